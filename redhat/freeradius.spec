@@ -883,6 +883,7 @@ fi
 %{_libdir}/freeradius/rlm_rediswho.so
 %{_libdir}/freeradius/rlm_cache_redis.so
 %{_libdir}/freeradius/rlm_redis_ippool.so
+%{_libdir}/freeradius/rlm_redis_state.so
 
 %files rest
 %defattr(-,root,root)
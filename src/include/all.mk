@@ -32,14 +32,20 @@ HEADERS	= \
 	radiusd.h \
 	radutmp.h \
 	realms.h \
+	reload.h \
 	sha1.h \
 	stats.h \
 	sysutmp.h \
 	token.h \
+	trie.h \
 	udpfromto.h \
 	base64.h \
 	map.h \
+	mapfile.h \
+	startup_trace.h \
+	probe.h \
 	udp.h \
+	udp_uring.h \
 	tcp.h \
 	threads.h \
 	regex.h \
@@ -44,6 +44,7 @@ extern "C" {
  *	Config file parsing
  */
 int		cf_file_read(CONF_SECTION *cs, char const *file);
+int		cf_file_read_cached(CONF_SECTION *cs, char const *file, char const *cache_file);
 void		cf_file_free(CONF_SECTION *cs);
 
 bool		cf_file_check(CONF_SECTION *cs, char const *filename, bool check_perms);
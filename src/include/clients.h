@@ -26,12 +26,30 @@
  */
 RCSIDH(clients_h, "$Id$")
 
+#include <freeradius-devel/md5.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 /** Describes a host allowed to send packets to the server
  *
  */
+#ifdef WITH_DYNAMIC_CLIENTS
+typedef struct client_admit_t client_admit_t;
+
+/** Counters for the lookups of dynamic clients in a network
+ *
+ */
+typedef struct {
+	uint64_t		lookups;		//!< Run through the dynamic_clients virtual server.
+	uint64_t		created;		//!< Lookups which created a client.
+	uint64_t		failed;			//!< Lookups which didn't.
+	uint64_t		coalesced;		//!< Packets dropped, as a lookup for the address was running.
+	uint64_t		negative;		//!< Packets dropped, as a lookup for the address recently failed.
+	uint64_t		rate_limited;		//!< Packets dropped, as the network had too many lookups.
+} client_admit_stats_t;
+#endif
+
 typedef struct radclient {
 	fr_ipaddr_t		ipaddr;			//!< IPv4/IPv6 address of the host.
 	fr_ipaddr_t		src_ipaddr;		//!< IPv4/IPv6 address to send responses
@@ -41,6 +59,8 @@ typedef struct radclient {
 	char const		*shortname;		//!< Client nickname.
 
 	char const		*secret;		//!< Secret PSK.
+	fr_hmac_md5_key_t	*hmac_key;		//!< HMAC-MD5 state precomputed from the secret,
+							//!< for Message-Authenticator.
 
 	bool			message_authenticator;	//!< Require RADIUS message authenticator in requests.
 
@@ -57,18 +77,23 @@ typedef struct radclient {
 	CONF_SECTION	 	*cs;			//!< CONF_SECTION that was parsed to generate the client.
 
 #ifdef WITH_STATS
-	fr_stats_t		auth;			//!< Authentication stats.
-#  ifdef WITH_ACCOUNTING
-	fr_stats_t		acct;			//!< Accounting stats.
-#  endif
-#  ifdef WITH_COA
-	fr_stats_t		coa;			//!< Change of Authorization stats.
-	fr_stats_t		dsc;			//!< Disconnect-Request stats.
-#  endif
+	uint32_t		stats_id;		//!< Of the client's counters, see radius_stats_local().
 #endif
 
+	struct fr_metric_set_t	*metrics;		//!< Counters for the metrics endpoint.  Allocated
+							//!< by the protocol, when the client is first used.
+
 	struct timeval		response_window;	//!< How long the client has to respond.
 
+	uint32_t		auth_rate;		//!< Authentication packets a second.  0 for no limit.
+	uint32_t		auth_burst;		//!< Authentication packets at once.
+	uint32_t		acct_rate;		//!< Accounting packets a second.  0 for no limit.
+	uint32_t		acct_burst;		//!< Accounting packets at once.
+	char const		*rate_action;		//!< "drop" or "defer" packets over the limit.
+	bool			rate_defer;		//!< Parsed "rate_action".
+	struct fr_rate_limit_t	*auth_limit;		//!< Token bucket for authentication packets, or NULL.
+	struct fr_rate_limit_t	*acct_limit;		//!< Token bucket for accounting packets, or NULL.
+
 	int			proto;			//!< Protocol number.
 #ifdef WITH_TCP
 	fr_socket_limit_t	limit;			//!< Connections per client (TCP clients only).
@@ -89,6 +114,9 @@ typedef struct radclient {
 	CONF_SECTION		*client_server_cs;	//!< Virtual server for creating dynamic clients
 
 	bool			rate_limit;		//!< Where addition of clients should be rate limited.
+	uint32_t		lookup_rate;		//!< Maximum lookups per second for the network.
+	uint32_t		negative_lifetime;	//!< How long failed lookups are remembered for.
+	client_admit_t		*admit;			//!< Lookups running, and which recently failed.
 #endif
 } RADCLIENT;
 
@@ -139,7 +167,15 @@ bool		client_add(RADCLIENT_LIST *clients, RADCLIENT *client);
 #ifdef WITH_DYNAMIC_CLIENTS
 void		client_delete(RADCLIENT_LIST *clients, RADCLIENT *client);
 
+bool		client_replace(RADCLIENT_LIST *clients, RADCLIENT *client);
+
 RADCLIENT	*client_afrom_request(RADCLIENT_LIST *clients, REQUEST *request);
+
+bool		client_admit(RADCLIENT *network, fr_ipaddr_t const *ipaddr, time_t now);
+
+void		client_admit_done(RADCLIENT *network, fr_ipaddr_t const *ipaddr, bool created, time_t now);
+
+void		client_admit_stats(RADCLIENT *network, client_admit_stats_t *stats);
 #endif
 
 int		client_map_section(CONF_SECTION *out, CONF_SECTION const *map, client_value_cb_t func, void *data);
@@ -99,7 +99,7 @@ typedef void (*fr_connection_close_t)(int fd, void *uctx);
 
 
 fr_connection_t		*fr_connection_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
-			       	       	     struct timeval *open_time, struct timeval *wait_time,
+			       	       	     struct timeval const *open_time, struct timeval const *wait_time,
 					     fr_connection_init_t init, fr_connection_open_t open,
 					     fr_connection_close_t close,
 					     char const *log_prefix,
@@ -87,6 +87,47 @@ typedef struct listen_detail_t {
 	RADCLIENT	detail_client;
 } listen_detail_t;
 
+/*
+ *	Binary detail records.  See src/main/detail.c for the format.
+ */
+#define FR_DETAIL_BINARY_HDR_LEN	(64)
+#define FR_DETAIL_BINARY_VERSION	(1)
+#define FR_DETAIL_BINARY_TEXT		(0xff)		//!< Attribute type for values written as text.
+
+extern uint8_t const fr_detail_binary_magic[4];
+
+/** The fixed fields of a binary detail record
+ *
+ */
+typedef struct {
+	uint8_t		code;				//!< Of the packet.
+	struct timeval	timestamp;			//!< When the packet was received.
+	fr_ipaddr_t	src_ipaddr;
+	fr_ipaddr_t	dst_ipaddr;
+	uint16_t	src_port;
+	uint16_t	dst_port;
+} fr_detail_record_t;
+
+/** Decide whether an attribute should be left out of a record
+ *
+ * @param[in] vp	to check.
+ * @param[in] uctx	passed to #fr_detail_binary_encode.
+ * @return true to leave the attribute out.
+ */
+typedef bool (*fr_detail_filter_t)(VALUE_PAIR const *vp, void *uctx);
+
+uint32_t	fr_detail_crc32(uint8_t const *data, size_t data_len);
+
+ssize_t		fr_detail_binary_encode(TALLOC_CTX *ctx, uint8_t **out, fr_detail_record_t const *rec,
+					VALUE_PAIR *vps, fr_detail_filter_t filter, void *uctx);
+
+ssize_t		fr_detail_binary_check(uint8_t const *data, size_t data_len);
+
+size_t		fr_detail_binary_resync(uint8_t const *data, size_t data_len);
+
+int		fr_detail_binary_decode(TALLOC_CTX *ctx, fr_detail_record_t *rec, VALUE_PAIR **vps,
+					uint8_t const *data, size_t data_len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -93,6 +93,7 @@ int		fr_event_list_num_fds(fr_event_list_t *el);
 int		fr_event_list_num_elements(fr_event_list_t *el);
 int		fr_event_list_kq(fr_event_list_t *el);
 int		fr_event_list_time(struct timeval *when, fr_event_list_t *el);
+int		fr_event_list_timer_wheel(fr_event_list_t *el, bool enable);
 
 int		fr_event_fd_delete(fr_event_list_t *el, int fd);
 int		fr_event_fd_insert(TALLOC_CTX *ctx, fr_event_list_t *el, int fd,
@@ -107,6 +108,7 @@ int		fr_event_timer_delete(fr_event_list_t *el, fr_event_timer_t const **ev);
 int		fr_event_timer_run(fr_event_list_t *el, struct timeval *when);
 
 uintptr_t      	fr_event_user_insert(fr_event_list_t *el, fr_event_user_handler_t user, void *uctx) CC_HINT(nonnull(1,2));
+int		fr_event_user_trigger(int kq, uintptr_t ident);
 int		fr_event_user_delete(fr_event_list_t *el, fr_event_user_handler_t user, void *uctx) CC_HINT(nonnull(1,2));
 
 int		fr_event_pre_insert(fr_event_list_t *el, fr_event_status_t callback, void *uctx) CC_HINT(nonnull(1,2));
@@ -132,5 +132,28 @@ int	fr_log_perror(fr_log_t const *log, fr_log_type_t type, char const *msg, ...)
 
 bool	fr_rate_limit_enabled(void);
 
+/** Counters for asynchronous logging
+ *
+ */
+typedef struct {
+	bool		running;	//!< Whether the writer thread is running.
+	size_t		ring_size;	//!< Of each thread's ring, in bytes.
+	uint32_t	rings;		//!< Threads which have logged.
+	uint64_t	queued;		//!< Bytes waiting to be written.
+	uint64_t	written;	//!< Messages written by the writer thread.
+	uint64_t	dropped;	//!< Messages dropped because a ring was full.
+	uint64_t	blocked;	//!< Times a thread waited for room in its ring.
+} fr_log_async_stats_t;
+
+int	fr_log_async_start(size_t ring_size, bool block);
+
+void	fr_log_async_stop(void);
+
+bool	fr_log_async_enabled(void);
+
+ssize_t	fr_log_async_write(fr_log_t const *log, int priority, char const *file, char const *msg, size_t msg_len);
+
+void	fr_log_async_stats(fr_log_async_stats_t *stats);
+
 
 #endif /* _FR_LOG_H */
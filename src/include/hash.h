@@ -43,10 +43,25 @@ typedef uint32_t (*fr_hash_table_hash_t)(void const *);
 typedef int (*fr_hash_table_cmp_t)(void const *, void const *);
 typedef int (*fr_hash_table_walk_t)(void * /* ctx */, void * /* data */);
 
+/*
+ *	Which implementation a table uses.  The API is the same for
+ *	both.
+ */
+typedef enum {
+	FR_HASH_TABLE_OPEN = 0,				//!< Open addressing, with the entries inline.
+							//!< Lookups never modify the table.  The default.
+	FR_HASH_TABLE_SPLIT				//!< Chained, with split-ordered lists.  One allocation
+							//!< per entry, and lookups may modify the table.
+} fr_hash_table_type_t;
+
 fr_hash_table_t *fr_hash_table_create(TALLOC_CTX *ctx,
 				      fr_hash_table_hash_t hashNode,
 				      fr_hash_table_cmp_t cmpNode,
 				      fr_hash_table_free_t freeNode);
+fr_hash_table_t *fr_hash_table_create_type(TALLOC_CTX *ctx, fr_hash_table_type_t type,
+					   fr_hash_table_hash_t hashNode,
+					   fr_hash_table_cmp_t cmpNode,
+					   fr_hash_table_free_t freeNode);
 void		fr_hash_table_free(fr_hash_table_t *ht);
 int		fr_hash_table_insert(fr_hash_table_t *ht, void const *data);
 int		fr_hash_table_delete(fr_hash_table_t *ht, void const *data);
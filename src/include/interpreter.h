@@ -96,6 +96,19 @@ typedef enum {
 	UNLANG_GROUP_TYPE_MAX			//!< Number of group types.
 } unlang_group_type_t;
 
+/** How the results of the children of a "parallel" section are merged
+ *
+ */
+typedef enum {
+	UNLANG_PARALLEL_ALL = 0,		//!< Wait for all of the children, and merge their results
+						//!< by priority.  A child whose action is "return" or
+						//!< "reject" cancels the others.
+	UNLANG_PARALLEL_FIRST,			//!< The first child to finish sets the result, and
+						//!< cancels the others.
+	UNLANG_PARALLEL_ANY			//!< The first child to return "ok" or "updated" sets the
+						//!< result, and cancels the others.
+} unlang_parallel_mode_t;
+
 /** A node in a graph of #unlang_op_t (s) that we execute
  *
  * The interpreter acts like a turing machine, with #unlang_t nodes forming the tape
@@ -132,10 +145,38 @@ typedef struct {
 	vp_map_t		*map;		//!< #UNLANG_TYPE_UPDATE, #UNLANG_TYPE_MAP.
 	vp_tmpl_t		*vpt;		//!< #UNLANG_TYPE_SWITCH, #UNLANG_TYPE_MAP.
 	fr_cond_t		*cond;		//!< #UNLANG_TYPE_IF, #UNLANG_TYPE_ELSIF.
+#ifdef HAVE_REGEX
+	regex_t			*prefilter;	//!< #UNLANG_TYPE_IF, #UNLANG_TYPE_ELSIF, the regular expressions
+						//!< of this condition and the following "elsif" conditions,
+						//!< combined.  If it doesn't match, none of them can.
+	unlang_t		*prefilter_last;	//!< The last "elsif" covered by the prefilter.
+#endif
 
 	map_proc_inst_t		*proc_inst;	//!< Instantiation data for #UNLANG_TYPE_MAP.
+
+	rbtree_t		*cases;		//!< #UNLANG_TYPE_SWITCH, "case" statements indexed
+						//!< by value.  NULL if none of them can be indexed.
+	bool			dynamic_cases;	//!< #UNLANG_TYPE_SWITCH, some "case" statements aren't
+						//!< in the index, and must be evaluated in turn.
+	bool			indexed;	//!< #UNLANG_TYPE_CASE, the value is in the index of
+						//!< the parent "switch".
+
+	unlang_parallel_mode_t	parallel;	//!< #UNLANG_TYPE_PARALLEL, how the results of the
+						//!< children are merged.
 } unlang_group_t;
 
+/** An entry in the index of "case" statements for a "switch"
+ *
+ */
+typedef struct {
+	fr_value_box_t const	*value;		//!< To match.
+	fr_value_box_t		name;		//!< Literal string of the "case", when switching
+						//!< over an expansion.
+	unlang_t		*instruction;	//!< The "case" statement.
+	int			order;		//!< Position in the "switch".  The first matching
+						//!< "case" statement wins.
+} unlang_case_t;
+
 /** A call to a module method
  *
  */
@@ -196,6 +237,11 @@ typedef struct {
  */
 typedef struct {
 	module_thread_instance_t *thread;	//!< thread-local data for this module
+	module_generation_t	*generation;	//!< of the instance data.  NULL if the module can't be reloaded.
+	void			*inst;		//!< Instance data the module was called with.
+	uint64_t		start;		//!< fr_time() when the module was called, for the metrics.
+	uint64_t		yielded;	//!< fr_time() when the module last yielded, for the metrics.
+	int			trace_span;	//!< span for the call, if the request is traced, or -1.
 } unlang_stack_state_modcall_t;
 
 /** State of a foreach loop
@@ -264,6 +310,8 @@ typedef struct {
 
 	bool			resume : 1;			//!< resume the current section after calling a sub-section
 	bool			top_frame : 1;			//!< are we the top frame of the stack?
+	int			trace_span;			//!< span for the section, if this is the top frame
+								///< of a traced request, or -1.
 
 	union {
 		unlang_stack_state_foreach_t	foreach;	//!< Foreach iterator state.
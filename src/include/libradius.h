@@ -227,6 +227,7 @@ typedef struct fr_randctx {
 void		fr_isaac(fr_randctx *ctx);
 void		fr_randinit(fr_randctx *ctx, int flag);
 uint32_t	fr_rand(void);	/* like rand(), but better. */
+void		fr_rand_bytes(void *out, size_t len);
 void		fr_rand_seed(void const *, size_t ); /* seed the random pool */
 
 
@@ -260,6 +261,8 @@ int		fr_socket_wait_for_connect(int sockfd, struct timeval const *timeout);
 int		fr_socket_server_udp(fr_ipaddr_t const *ipaddr, uint16_t *port, char const *port_name, bool async);
 int		fr_socket_server_tcp(fr_ipaddr_t const *ipaddr, uint16_t *port, char const *port_name, bool async);
 int		fr_socket_bind(int sockfd, fr_ipaddr_t const *ipaddr, uint16_t *port, char const *interface);
+int		fr_socket_reuse_port(int sockfd);
+int		fr_socket_reuse_port_steer(int sockfd, uint32_t num);
 #ifdef __cplusplus
 }
 #endif
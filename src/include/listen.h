@@ -112,7 +112,7 @@ struct rad_listen {
 	void			*data;
 
 #ifdef WITH_STATS
-	fr_stats_t		stats;
+	uint32_t		stats_id;	//!< Of the listener's counters, see radius_stats_local().
 #endif
 };
 
@@ -0,0 +1,71 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_MAPFILE_H
+#define _FR_MAPFILE_H
+/**
+ * $Id$
+ *
+ * @file include/mapfile.h
+ * @brief Look up lines of a memory mapped text file by key.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSIDH(mapfile_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_mapfile_t fr_mapfile_t;
+
+/** Where a lookup has got to
+ *
+ */
+typedef struct {
+	uint32_t	hash;		//!< Of the key we're looking for.
+	uint32_t	slot;		//!< The next slot to look at.
+} fr_mapfile_cursor_t;
+
+/** Find the keys in one line of the file
+ *
+ * Calls fr_mapfile_add() for each key the line should be found by.
+ *
+ * @param[in] mf	being indexed.
+ * @param[in] line	not including the end of line.  Not '\\0' terminated.
+ * @param[in] len	of the line.
+ * @param[in] lineno	of the line, starting at 1.
+ * @param[in] uctx	passed to fr_mapfile_alloc().
+ * @return
+ *	- 0 on success.
+ *	- -1 if the file is malformed, and shouldn't be used.
+ */
+typedef int (*fr_mapfile_key_t)(fr_mapfile_t *mf, char const *line, size_t len, uint64_t lineno, void *uctx);
+
+fr_mapfile_t	*fr_mapfile_alloc(TALLOC_CTX *ctx, char const *filename, fr_mapfile_key_t key, void *uctx);
+
+void		fr_mapfile_add(fr_mapfile_t *mf, char const *key, size_t key_len);
+
+uint64_t	fr_mapfile_num_keys(fr_mapfile_t const *mf);
+
+char const	*fr_mapfile_find(fr_mapfile_t const *mf, fr_mapfile_cursor_t *cursor,
+				 char const *key, size_t key_len, size_t *len);
+
+char const	*fr_mapfile_next(fr_mapfile_t const *mf, fr_mapfile_cursor_t *cursor, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_MAPFILE_H */
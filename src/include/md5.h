@@ -36,6 +36,10 @@ extern "C" {
 #  define MD5_DIGEST_LENGTH 16
 #endif
 
+#ifndef MD5_BLOCK_LENGTH
+#  define MD5_BLOCK_LENGTH 64
+#endif
+
 #ifndef HAVE_OPENSSL_EVP_H
 /*
  * The MD5 code used here and in md5.c was originally retrieved from:
@@ -51,7 +55,6 @@ extern "C" {
  * except that you don't need to include two pages of legalese
  * with every copy.
  */
-#  define MD5_BLOCK_LENGTH 64
 typedef struct FR_MD5Context {
 	uint32_t state[4];			//!< State.
 	uint32_t count[2];			//!< Number of bits, mod 2^64.
@@ -78,14 +81,43 @@ USES_APPLE_DEPRECATED_API
 #  define fr_md5_copy(_out, _in)	memcpy(_out, _in, sizeof(*_out))
 #endif
 
+/** HMAC-MD5 state precomputed from a key
+ *
+ * Both contexts have absorbed exactly one block, and are cloned for each message.
+ */
+typedef struct {
+	FR_MD5_CTX		inner;			//!< After absorbing key ^ ipad.
+	FR_MD5_CTX		outer;			//!< After absorbing key ^ opad.
+} fr_hmac_md5_key_t;
+
 /* hmac.c */
 void	fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
 		    uint8_t const *key, size_t key_len)
 	CC_BOUNDED(__minbytes__, 1, MD5_DIGEST_LENGTH);
+void	fr_hmac_md5_key_init(fr_hmac_md5_key_t *hmac_key, uint8_t const *key, size_t key_len);
+void	fr_hmac_md5_precomputed(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
+				fr_hmac_md5_key_t const *hmac_key)
+	CC_BOUNDED(__minbytes__, 1, MD5_DIGEST_LENGTH);
 
 /* md5.c */
 void	fr_md5_calc(uint8_t *out, uint8_t const *in, size_t inlen);
 
+/** One message for fr_md5_calc_multi()
+ *
+ * The message is the concatenation of the two segments.  Either may be empty.
+ */
+typedef struct {
+	uint8_t const		*in[2];			//!< Data to hash, in order.
+	size_t			inlen[2];		//!< Length of each segment.
+	uint8_t			*out;			//!< Where to write the digest.
+							///< Must be a minimum of MD5_DIGEST_LENGTH.
+	FR_MD5_CTX const	*ctx;			//!< State to start from, or NULL to start a
+							///< new hash.  Must have absorbed a whole
+							///< number of blocks.
+} fr_md5_multi_t;
+
+void	fr_md5_calc_multi(fr_md5_multi_t const *msg, int num);
+
 #ifdef __cplusplus
 }
 #endif
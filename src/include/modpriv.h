@@ -33,15 +33,39 @@ RCSIDH(modpriv_h, "$Id$")
 extern "C" {
 #endif
 
+typedef struct module_instance_t module_instance_t;
+
+/** A generation of a module's instance data
+ *
+ * Modules which can be reloaded get a new generation each time they're
+ * reloaded.  Requests hold a reference to the generation they're using,
+ * so it isn't freed until they're done with it.
+ */
+typedef struct module_generation_t {
+	module_instance_t		*mod_inst;	//!< Module this is a generation of.
+
+	dl_instance_t			*dl_inst;	//!< Instance data and configuration.
+
+	uint64_t			refs;		//!< Number of requests using this generation.
+
+	size_t				memory_used;	//!< Size of the instance data, counted in the
+							//!< module's memory set.
+
+	struct module_generation_t	*next;		//!< Next oldest generation which isn't current.
+} module_generation_t;
+
 /** Per instance data
  *
  * Per-instance data structure, to correlate the modules with the
  * instance names (may NOT be the module names!), and the per-instance
  * data structures.
  */
-typedef struct {
+struct module_instance_t {
 	char const			*name;		//!< Instance name e.g. user_database.
 
+	uint32_t			number;		//!< Index of the module's data in each
+							//!< thread's array of thread instances.
+
 	dl_instance_t			*dl_inst;	//!< Structure containing the module's instance data,
 							//!< configuration, and dl handle.
 
@@ -51,12 +75,39 @@ typedef struct {
 
 	bool				instantiated;	//!< Whether the module has been instantiated yet.
 
+	bool				instantiating;	//!< Whether the module is being instantiated.
+	void				*instantiated_by;	//!< Startup thread instantiating the module.
+
 	bool				force;		//!< Force the module to return a specific code.
 							//!< Usually set via an administrative interface.
 
 	rlm_rcode_t			code;		//!< Code module will return when 'force' has
 							//!< has been set to true.
-} module_instance_t;
+
+	pthread_mutex_t			*hup_mutex;	//!< Protects the generations.  Only set if
+							//!< the module can be reloaded.
+	module_generation_t		*generation;	//!< Current generation of the instance data.
+	module_generation_t		*retired;	//!< Older generations, which requests may still be using.
+
+	bool				hup_pending;	//!< A file loaded by the module has changed.
+	time_t				last_hup;	//!< When the module was last reloaded.
+
+	struct fr_metric_set_t		*memory;	//!< Memory used by the module.  See io/memory.h.
+	size_t				memory_used;	//!< Size of the instance data, counted in "memory".
+};
+
+/** The metrics kept for each module, in each thread
+ *
+ */
+typedef enum {
+	MODULE_METRIC_CALLS = 0,			//!< Calls to the module.
+	MODULE_METRIC_ACTIVE,				//!< Calls which have yielded, and not finished.
+	MODULE_METRIC_LATENCY,				//!< From the call, to the final result.
+	MODULE_METRIC_RUN_TIME,				//!< Time spent running the module, in nanoseconds.
+	MODULE_METRIC_YIELD_TIME,			//!< Time calls spent yielded, in nanoseconds.
+	MODULE_METRIC_RCODE,				//!< The first of one counter per return code.
+	MODULE_METRIC_MAX = MODULE_METRIC_RCODE + RLM_MODULE_NUMCODES
+} module_metric_t;
 
 /** Per thread per instance data
  *
@@ -69,12 +120,22 @@ typedef struct {
 
 	uint64_t			total_calls;	//! total number of times we've been called
 	uint64_t			active_callers; //! number of active callers.  i.e. number of current yields
+
+	struct fr_metric_set_t		*metrics;	//!< Indexed by module_metric_t.  May be NULL.
+
+	size_t				memory_used;	//!< Size of the thread instance data, when this
+							//!< thread last measured it.
 } module_thread_instance_t;
 
 module_instance_t	*module_find_with_method(rlm_components_t *method,
 						 CONF_SECTION *modules, char const *asked_name);
 module_instance_t	*module_find(CONF_SECTION *modules, char const *asked_name);
 int			module_sibling_section_find(CONF_SECTION **out, CONF_SECTION *module, char const *name);
+void			*module_instance_acquire(module_generation_t **generation, module_instance_t *mod_inst);
+void			module_instance_release(module_generation_t *generation);
+int			module_hup_module(module_instance_t *mod_inst, CONF_SECTION *cs, fr_event_list_t *el, time_t when);
+bool			module_hup_pending(CONF_SECTION *modules, CONF_SECTION *cs);
+int			modules_hup(CONF_SECTION *modules, fr_event_list_t *el);
 int			unlang_fixup_update(vp_map_t *map, void *ctx);
 
 #ifdef __cplusplus
@@ -30,6 +30,7 @@ RCSIDH(modules_h, "$Id$")
 #include <freeradius-devel/features.h>
 #include <freeradius-devel/pool.h>
 #include <freeradius-devel/exfile.h>
+#include <freeradius-devel/io/memory.h>
 #include <freeradius-devel/io/schedule.h>
 
 #ifdef __cplusplus
@@ -78,7 +79,15 @@ extern const section_type_value_t section_type_value[];
 #define RLM_TYPE_THREAD_UNSAFE	(1 << 0) 	//!< Module is not threadsafe.
 						//!< Server will protect calls
 						//!< with mutex.
+#define RLM_TYPE_HUP_SAFE	(1 << 1) 	//!< Will be reloaded on HUP.  Server will
+						//!< instantiate a new instance, and free the
+						//!< old one when requests are done with it.
 #define RLM_TYPE_RESUMABLE     	(1 << 2) 	//!< does yield / resume
+#define RLM_TYPE_INSTANTIATE_MAIN	(1 << 3)	//!< Must be instantiated by the main thread,
+						//!< not in parallel with other modules.
+#define RLM_TYPE_SHADOW_SAFE	(1 << 4)	//!< Has no effects outside of the request, so may be
+						//!< called for mirrored packets.  Other modules return
+						//!< noop for them.
 
 /** Module section callback
  *
@@ -183,6 +192,7 @@ int		modules_instantiate(CONF_SECTION *root) CC_HINT(nonnull);
 int		modules_bootstrap(CONF_SECTION *root) CC_HINT(nonnull);
 int		modules_free(void);
 int		module_instance_read_only(TALLOC_CTX *ctx, char const *name);
+fr_memory_t	*module_memory(CONF_SECTION *module) CC_HINT(nonnull);
 
 /*
  *	Call various module sections
@@ -210,6 +220,7 @@ int		virtual_servers_open(fr_schedule_t *sc);
 int		virtual_servers_instantiate(CONF_SECTION *config);
 int		virtual_servers_bootstrap(CONF_SECTION *config);
 CONF_SECTION	*virtual_server_find(char const *name);
+void		virtual_server_budget_set(REQUEST *request);
 void		fr_request_async_bootstrap(REQUEST *request, fr_event_list_t *el); /* for unit_test_module */
 
 /*
@@ -223,6 +234,21 @@ rlm_rcode_t	unlang_interpret(REQUEST *request, CONF_SECTION *cs, rlm_rcode_t def
 
 rlm_rcode_t	unlang_interpret_synchronous(REQUEST *request, CONF_SECTION *cs, rlm_rcode_t action);
 
+/** Which counter to print from the unlang profiler
+ *
+ */
+typedef enum {
+	UNLANG_PROFILE_TIME = 0,		//!< Microseconds spent in each instruction.
+	UNLANG_PROFILE_CALLS,			//!< How many times each instruction was run.
+	UNLANG_PROFILE_YIELDS			//!< How many times each instruction yielded.
+} unlang_profile_metric_t;
+
+void		unlang_profile_start(uint32_t rate);
+
+void		unlang_profile_stop(void);
+
+char		*unlang_profile_collapsed(TALLOC_CTX *ctx, unlang_profile_metric_t metric);
+
 int		unlang_compile(CONF_SECTION *cs, rlm_components_t component);
 int		unlang_compile_subsection(CONF_SECTION *server_cs, char const *name1, char const *name2, rlm_components_t component);
 
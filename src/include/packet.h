@@ -35,6 +35,8 @@ extern "C" {
 
 #define AUTH_VECTOR_LEN		16
 
+typedef struct fr_radius_lazy_s fr_radius_lazy_t;
+
 /*
  *	vector:		Request authenticator from access-request packet
  *			Put in there by rad_decode, and must be put in the
@@ -62,6 +64,8 @@ typedef struct radius_packet {
 	uint8_t			*data;			//!< Packet data (body).
 	size_t			data_len;		//!< Length of packet data.
 	VALUE_PAIR		*vps;			//!< Result of decoding the packet into VALUE_PAIRs.
+	fr_radius_lazy_t	*lazy;			//!< Attributes in "data" which haven't been
+							//!< decoded into "vps" yet.
 
 	uint32_t       		rounds;			//!< for State[0]
 
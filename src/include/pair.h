@@ -93,6 +93,9 @@ typedef struct value_pair {
 
 	value_type_t		type;				//!< Type of pointer in value union.
 	fr_value_box_t		data;
+
+	void const		*encoded;			//!< Protocol specific pre-encoded form of the
+								//!< pair.  Owned by the original, shared with copies.
 } VALUE_PAIR;
 
 /** Abstraction to allow iterating over different configurations of VALUE_PAIRs
@@ -86,6 +86,10 @@ struct fr_pcap {
 	int			buffer_pkts;			//!< How big to make the PCAP ring buffer.
 								//!< Actual buffer size is SNAPLEN * buffer.
 								//!< Only valid for live capture handles.
+	int			fanout_group;			//!< PACKET_FANOUT group to join, 0 for none.
+								//!< Handles in the same group share the packets
+								//!< seen on the interface, hashed by flow.
+								//!< Only valid for live capture handles on Linux.
 
 	pcap_t			*handle;			//!< libpcap handle.
 	pcap_dumper_t		*dumper;			//!< libpcap dumper handle.
@@ -34,6 +34,7 @@ extern "C" {
 #endif
 
 typedef struct fr_pool fr_pool_t;
+typedef struct fr_pool_thread fr_pool_thread_t;
 
 typedef struct fr_pool_state {
 	uint32_t	pending;		//!< Number of pending open connections.
@@ -63,6 +64,14 @@ typedef struct fr_pool_state {
 	uint32_t       	num;			//!< Number of connections in the pool.
 	uint32_t	active;	 		//!< Number of currently reserved connections.
 
+	uint32_t	thread_idle;		//!< Connections kept by threads for their own use.
+						//!< Included in active.
+	uint64_t	thread_reserved;	//!< Number of reservations made without locking the pool.
+
+	uint64_t	latency;		//!< Moving average of how long connections are held for,
+						//!< in microseconds.
+	uint32_t	utilisation;		//!< Moving average of the percentage of connections in use.
+
 	bool		reconnecting;		//!< We are currently reconnecting the pool.
 } fr_pool_state_t;
 
@@ -131,6 +140,15 @@ fr_pool_t	*fr_pool_init(TALLOC_CTX *ctx,
 						 fr_pool_connection_alive_t a,
 						 char const *log_prefix);
 
+fr_pool_t	*fr_pool_alloc(TALLOC_CTX *ctx,
+						  CONF_SECTION const *cs,
+						  void *opaque,
+						  fr_pool_connection_create_t c,
+						  fr_pool_connection_alive_t a,
+						  char const *log_prefix);
+
+int		fr_pool_start(fr_pool_t *pool);
+
 fr_pool_t	*fr_pool_copy(TALLOC_CTX *ctx, fr_pool_t *pool, void *opaque);
 
 
@@ -148,6 +166,8 @@ void	fr_pool_ref(fr_pool_t *pool);
 
 fr_pool_state_t const *fr_pool_state(fr_pool_t *pool);
 
+fr_pool_thread_t *fr_pool_thread_alloc(TALLOC_CTX *ctx, fr_pool_t *pool);
+
 void	fr_pool_reconnect_func(fr_pool_t *pool, fr_pool_reconnect_t reconnect);
 
 /*
@@ -0,0 +1,79 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_PROBE_H
+#define _FR_PROBE_H
+/**
+ * $Id$
+ *
+ * @file include/probe.h
+ * @brief Static probe points, for DTrace, SystemTap, bpftrace and perf.
+ *
+ * Each probe is a single nop instruction, plus a note in the ELF file
+ * which says where the nop is, and where to find the arguments.  A
+ * tracer which attaches to the probe replaces the nop with a trap.
+ * So the probes cost almost nothing when nothing is attached.
+ *
+ * All of the probes are in the "freeradius" provider, e.g.
+ *
+ *	bpftrace -e 'usdt:/usr/sbin/radiusd:freeradius:worker_request_start { ... }'
+ *
+ * Arguments are integers or pointers.  Strings are passed as char
+ * pointers, which the tracer has to copy.  Times are fr_time_t, in
+ * nanoseconds.
+ *
+ * The probes, and their arguments, are:
+ *
+ *	network_packet_received		network, listener name, size, receive time
+ *	channel_send_request		channel, sequence, receive time
+ *	worker_request_start		request number, receive time
+ *	worker_request_end		request number, fr_io_final_t
+ *	worker_send_reply		request number, size, CPU time
+ *	module_call			request number, module name
+ *	module_yield			request number, module name
+ *	module_resume			request number, module name
+ *	module_return			request number, module name, rcode
+ *	pool_connection_get		pool name
+ *	pool_connection_reserved	pool name, connection number, or 0 for none
+ *	pool_connection_release		pool name, connection
+ *	state_lookup			request number, whether the state was found
+ *	radius_send			request number, home server, code, ID
+ *	radius_receive			request number, home server, code, round trip time
+ *
+ * The probes are compiled in when <sys/sdt.h> is available.
+ * Otherwise, the macros expand to nothing, and the arguments are
+ * not evaluated.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSIDH(probe_h, "$Id$")
+
+#ifdef HAVE_SYS_SDT_H
+#  include <sys/sdt.h>
+
+#  define FR_PROBE(_name)			DTRACE_PROBE(freeradius, _name)
+#  define FR_PROBE1(_name, _a)			DTRACE_PROBE1(freeradius, _name, _a)
+#  define FR_PROBE2(_name, _a, _b)		DTRACE_PROBE2(freeradius, _name, _a, _b)
+#  define FR_PROBE3(_name, _a, _b, _c)		DTRACE_PROBE3(freeradius, _name, _a, _b, _c)
+#  define FR_PROBE4(_name, _a, _b, _c, _d)	DTRACE_PROBE4(freeradius, _name, _a, _b, _c, _d)
+#else
+#  define FR_PROBE(_name)
+#  define FR_PROBE1(_name, _a)
+#  define FR_PROBE2(_name, _a, _b)
+#  define FR_PROBE3(_name, _a, _b, _c)
+#  define FR_PROBE4(_name, _a, _b, _c, _d)
+#endif
+
+#endif /* _FR_PROBE_H */
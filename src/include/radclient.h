@@ -89,6 +89,67 @@ struct rc_request {
 	char const	*name;		//!< Test name (as specified in the request).
 };
 
+#define RC_HISTOGRAM_SUB_BITS	3		//!< Each power of two microseconds is split into
+						//!< 2^RC_HISTOGRAM_SUB_BITS buckets.
+#define RC_HISTOGRAM_MAX_BITS	27		//!< Latencies above 2^27us (~134s) go in the last bucket.
+#define RC_HISTOGRAM_BUCKETS	((RC_HISTOGRAM_MAX_BITS - RC_HISTOGRAM_SUB_BITS + 1) << RC_HISTOGRAM_SUB_BITS)
+
+/** Log-linear histogram of latencies, in microseconds
+ *
+ */
+typedef struct rc_histogram {
+	uint64_t	count;				//!< Number of values recorded.
+	uint64_t	bucket[RC_HISTOGRAM_BUCKETS];	//!< Counts for each bucket.
+} rc_histogram_t;
+
+/** Configuration for load generation mode
+ *
+ */
+typedef struct rc_load_config {
+	double		rate;		//!< Packets per second to send, across all threads.
+	bool		poisson;	//!< Send with exponentially distributed gaps, instead of
+					//!< evenly spaced.
+	uint32_t	threads;	//!< Number of sending threads.
+	uint32_t	ports;		//!< Number of source ports (sockets) for each thread.
+	float		duration;	//!< How long to send for, in seconds.
+	float		timeout;	//!< How long to wait for a reply before it's counted as lost.
+	fr_ipaddr_t	client_ipaddr;	//!< Address to send from.
+	char const	*secret;	//!< Shared secret.  Must be talloced.
+	bool		do_output;	//!< Whether to print anything.
+} rc_load_config_t;
+
+/** Configuration for pcap replay mode
+ *
+ */
+typedef struct rc_replay_config {
+	char const	*filename;	//!< pcap file to replay.
+	double		speed;		//!< Multiplier for the captured timing.  0 sends as fast
+					//!< as possible.
+	char const	*secrets;	//!< File of "<client> <secret>" lines, giving the secrets
+					//!< the captured packets were signed with.
+	uint32_t	ports;		//!< Number of source ports (sockets).
+	float		timeout;	//!< How long to wait for a reply before it's counted as lost.
+	fr_ipaddr_t	client_ipaddr;	//!< Address to send from.
+	fr_ipaddr_t	server_ipaddr;	//!< Server to send to.
+	uint16_t	server_port;	//!< Port to send to, or 0 to use the captured port.
+	char const	*secret;	//!< Shared secret of the server.  Must be talloced.
+	bool		do_output;	//!< Whether to print anything.
+} rc_replay_config_t;
+
+/*
+ *	radclient_load.c
+ */
+uint64_t	rc_time_now(void);
+void		rc_histogram_add(rc_histogram_t *h, uint64_t usec);
+void		rc_histogram_print(FILE *fp, rc_histogram_t const *h);
+
+int		rc_load_run(rc_load_config_t const *config, rc_request_t *head);
+
+/*
+ *	radclient_replay.c
+ */
+int		rc_replay_run(rc_replay_config_t const *config);
+
 #ifdef __cplusplus
 }
 #endif
@@ -107,6 +107,7 @@ typedef	rlm_rcode_t (*RAD_REQUEST_FUNP)(REQUEST *);
 typedef struct main_config {
 	char const	*name;				//!< Name of the daemon, usually 'radiusd'.
 	CONF_SECTION	*config;			//!< Root of the server config.
+	char const	*config_cache;			//!< Where the parsed config is cached, or NULL.
 
 	bool		log_auth;			//!< Log authentication attempts.
 	bool		log_auth_badpass;		//!< Log successful authentications.
@@ -138,6 +139,11 @@ typedef struct main_config {
 	char const	*log_file;
 	int		syslog_facility;
 
+	bool		log_async;			//!< Write log messages from a dedicated thread.
+	size_t		log_async_ring_size;		//!< Bytes of log messages each thread can queue.
+	char const	*log_async_overflow;		//!< What to do when a thread's queue is full.
+	bool		log_async_block;		//!< Wait for room, instead of dropping the message.
+
 	char const	*dictionary_dir;		//!< Where to load dictionaries from.
 
 	char const	*checkrad;			//!< Script to use to determine if a user is already
@@ -159,6 +165,13 @@ typedef struct main_config {
 	char const	*allow_vulnerable_openssl;	//!< The CVE number of the last security issue acknowledged.
 #endif
 
+	uint32_t	num_instantiate;		//!< Number of threads instantiating modules at startup.
+
+#ifdef WITH_TLS
+	uint32_t	num_crypto;			//!< Number of threads performing TLS private key
+							//!< operations on behalf of the workers.
+#endif
+
 #ifdef WITH_CONF_WRITE
 	char const	*write_dir;			//!< where the normalized config is written
 #endif
@@ -185,6 +198,19 @@ typedef struct main_config {
 							//!< Only applicable in single threaded mode.
 
 	bool		namespace;			//!< Only for new listeners
+
+	struct fr_schedule_config_t *schedule;		//!< Placement of network and worker threads.
+
+	struct fr_schedule_t *scheduler;		//!< The network and worker threads, for radmin.
+
+	char const	*metrics_listen;		//!< "port" or "address:port" to serve metrics on.
+
+	char const	*trace_endpoint;		//!< OTLP/HTTP collector to send traces to, or NULL.
+	uint32_t	trace_sample_rate;		//!< Trace one in this many requests.
+	char const	*trace_service_name;		//!< Service name the traces are reported as.
+
+	size_t		state_soft_limit;		//!< Expire the oldest session-state early above this.
+	size_t		state_hard_limit;		//!< Refuse new sessions above this.
 } main_config_t;
 
 #ifdef WITH_VERIFY_PTR
@@ -303,6 +329,8 @@ struct rad_request {
 	main_config_t		*root;		//!< Pointer to the main config hack to try and deal with hup.
 
 	bool			in_request_hash;
+	bool			recycle;	//!< The stack isn't a talloc child of the request.
+						//!< See request_alloc_recycled().
 #ifdef WITH_PROXY
 	bool			in_proxy_hash;
 #endif
@@ -405,6 +433,9 @@ void 		rdebug_pair_list(fr_log_lvl_t level, REQUEST *, VALUE_PAIR *, char const
 void		rdebug_proto_pair_list(fr_log_lvl_t level, REQUEST *, VALUE_PAIR *, char const *);
 int		log_err (char *);
 
+/* metrics.c */
+int		metrics_open(fr_event_list_t *el);
+
 /* util.c */
 #define MEM(x) if (!(x)) { ERROR("%s[%u] OUT OF MEMORY", __FILE__, __LINE__); _fr_exit_now(__FILE__, __LINE__, 1); }
 void (*reset_signal(int signo, void (*func)(int)))(int);
@@ -417,6 +448,8 @@ ssize_t		rad_filename_unescape(char *out, size_t outlen, char const *in, size_t
 void		talloc_const_free(void const *ptr);
 char		*rad_ajoin(TALLOC_CTX *ctx, char const **argv, int argc, char c);
 REQUEST		*request_alloc(TALLOC_CTX *ctx);
+REQUEST		*request_alloc_recycled(TALLOC_CTX *ctx, void *stack, TALLOC_CTX *state_ctx);
+void		request_recycle(REQUEST *request, void **stack, TALLOC_CTX **state_ctx);
 REQUEST		*request_alloc_fake(REQUEST *oldreq);
 REQUEST		*request_alloc_proxy(REQUEST *request);
 int		request_data_add(REQUEST *request, void const *unique_ptr, int unique_int, void *opaque,
@@ -510,6 +543,8 @@ char	*auth_name(char *buf, size_t buflen, REQUEST *request, bool do_cli);
 rlm_rcode_t    	rad_authenticate (REQUEST *);
 rlm_rcode_t    	rad_postauth(REQUEST *);
 rlm_rcode_t    	rad_virtual_server(REQUEST *);
+rlm_rcode_t	rad_virtual_server_child(REQUEST *);
+void		rad_virtual_server_child_cancel(REQUEST *);
 
 /* exec.c */
 extern pid_t	(*rad_fork)(void);
@@ -523,6 +558,8 @@ int radius_readfrom_program(int fd, pid_t pid, int timeout,
 int radius_exec_program(TALLOC_CTX *ctx, char *out, size_t outlen, VALUE_PAIR **output_pairs,
 			REQUEST *request, char const *cmd, VALUE_PAIR *input_pairs,
 			bool exec_wait, bool shell_escape, int timeout) CC_HINT(nonnull (5, 6));
+int radius_exec_launcher_start(void);
+void radius_exec_launcher_stop(void);
 void trigger_exec_init(CONF_SECTION const *cs);
 int trigger_exec(REQUEST *request, CONF_SECTION const *cs, char const *name, bool quench, VALUE_PAIR *args)
 		  CC_HINT(nonnull (3));
@@ -536,6 +573,7 @@ int paircompare_register(fr_dict_attr_t const *attribute, fr_dict_attr_t const *
 			 bool first_only, RAD_COMPARE_FUNC func, void *instance);
 void		paircompare_unregister(fr_dict_attr_t const *attr, RAD_COMPARE_FUNC func);
 void		paircompare_unregister_instance(void *instance);
+bool		paircompare_registered(fr_dict_attr_t const *attribute);
 int		paircompare(REQUEST *request, VALUE_PAIR *req_list,
 			    VALUE_PAIR *check, VALUE_PAIR **rep_list);
 vp_tmpl_t	*xlat_to_tmpl_attr(TALLOC_CTX *ctx, xlat_exp_t *xlat);
@@ -593,7 +631,7 @@ void set_radius_dir(TALLOC_CTX *ctx, char const *path);
 char const *get_radius_dir(void);
 int main_config_init(void);
 int main_config_free(void);
-void main_config_hup(void);
+void main_config_hup(fr_event_list_t *el);
 void hup_logfile(void);
 
 
@@ -28,6 +28,7 @@
 RCSIDH(radsniff_h, "$Id$")
 
 #include <sys/types.h>
+#include <pthread.h>
 
 #include <freeradius-devel/libradius.h>
 #include <freeradius-devel/pcap.h>
@@ -44,6 +45,16 @@ RCSIDH(radsniff_h, "$Id$")
 #define RS_RETRANSMIT_MAX	5		//!< Maximum number of times we expect to see a packet retransmitted
 #define RS_MAX_ATTRS		50		//!< Maximum number of attributes we can filter on.
 #define RS_SOCKET_REOPEN_DELAY  5000		//!< How long we delay re-opening a collectd socket.
+#define RS_THREADS_MAX		64		//!< Maximum number of capture threads.
+#define RS_PEERS_MAX		4096		//!< Maximum number of NASs and home servers we keep
+						//!< latency stats for.
+
+#define RS_HISTOGRAM_SUB_BITS	3		//!< Each power of two microseconds is split into
+						//!< 2^RS_HISTOGRAM_SUB_BITS buckets, so values are
+						//!< accurate to within 6.25%.
+#define RS_HISTOGRAM_MAX_BITS	27		//!< Latencies above 2^27us (~134s) go in the last bucket.
+#define RS_HISTOGRAM_BUCKETS	((RS_HISTOGRAM_MAX_BITS - RS_HISTOGRAM_SUB_BITS + 1) << RS_HISTOGRAM_SUB_BITS)
+#define RS_PERCENTILES		4		//!< p50, p90, p99 and p999.
 
 /*
  *	Logging macros
@@ -96,6 +107,15 @@ typedef struct rs_counters {
 	uint64_t type[FR_CODE_MAX];
 } rs_counters_t;
 
+/** Log-linear latency histogram
+ *
+ * Histograms for the same interval can be merged by adding their buckets.
+ */
+typedef struct rs_histogram {
+	uint64_t		count;				//!< Number of values recorded.
+	uint64_t		bucket[RS_HISTOGRAM_BUCKETS];	//!< Counts for each bucket.
+} rs_histogram_t;
+
 /** Stats for a single interval
  *
  * And interval is defined as the time between a call to the stats output function.
@@ -130,9 +150,38 @@ typedef struct rs_latency {
 
 		double			latency_high;		//!< Latency high water mark.
 		double			latency_low;		//!< Latency low water mark.
+
+		rs_histogram_t		histogram;		//!< Latencies in the interval.
+		double			latency_percentile[RS_PERCENTILES];	//!< Percentiles of latency in the
+										//!< interval, in milliseconds.
 	} interval;
+
+	struct {
+		uint64_t		received;		//!< Total received since we started.
+		uint64_t		linked;			//!< Total request/response pairs since we started.
+		uint64_t		unlinked;		//!< Total unlinked since we started.
+		uint64_t		reused;			//!< Total reused since we started.
+		uint64_t		lost;			//!< Total lost since we started.
+		long double		latency;		//!< Total latency since we started, in milliseconds.
+	} total;
 } rs_latency_t;
 
+typedef enum {
+	RS_PEER_NAS = 0,				//!< Sent the request.
+	RS_PEER_HOME_SERVER				//!< Received the request.
+} rs_peer_type_t;
+
+/** Latency stats for a NAS or home server
+ *
+ */
+typedef struct rs_peer {
+	rs_peer_type_t		type;			//!< Whether this is a NAS or home server.
+	fr_ipaddr_t		ipaddr;			//!< Address of the NAS or home server.
+	FR_CODE			code;			//!< Code of the requests.
+
+	rs_latency_t		stats;			//!< Latency of requests to, or from the peer.
+} rs_peer_t;
+
 typedef struct rs_malformed {
 	uint64_t		min_length_packet;
 	uint64_t		min_length_field;
@@ -160,6 +209,9 @@ typedef struct rs_stats {
 
 	struct timeval		quiet;			//!< We may need to 'mute' the stats if libpcap starts
 							//!< dropping packets, or we run out of memory.
+
+	fr_hash_table_t		*peers;			//!< Latency stats for each NAS and home server.
+							//!< Only kept if we're writing OpenMetrics.
 } rs_stats_t;
 
 typedef struct rs_capture {
@@ -218,6 +270,32 @@ typedef struct rs_event {
 	rs_stats_t		*stats;			//!< Where to write stats.
 } rs_event_t;
 
+/** A capture thread
+ *
+ * Each thread has its own handle on each interface, and the handles for an
+ * interface are joined to a fanout group, so the kernel spreads flows across
+ * the threads.  Requests and responses for a flow are seen by the same thread,
+ * so each thread links packets with its own request trees.
+ */
+typedef struct rs_thread {
+	int			id;			//!< Thread number, from 0.
+	pthread_t		pthread_id;		//!< pthread ID of the thread.
+	bool			running;		//!< Whether the thread has been started.
+
+	TALLOC_CTX		*ctx;			//!< Everything the thread allocates is parented
+							//!< by this.
+	fr_event_list_t		*el;			//!< The thread's event list.
+	rbtree_t		*request_tree;		//!< Requests this thread is tracking.
+	rbtree_t		*link_tree;		//!< Requests this thread is linking retransmissions of.
+	fr_pcap_t		*in;			//!< The thread's capture handles.
+	int			pipe[2];		//!< Written to by the main thread to stop the thread.
+
+	pthread_mutex_t		mutex;			//!< Held while the thread is updating stats or
+							//!< reading from its handles.
+	rs_stats_t		*stats;			//!< Stats for the current interval.  Merged into
+							//!< the main stats by the main thread.
+} rs_thread_t;
+
 typedef struct rs_update rs_update_t;
 
 /** Callback for printing stats header.
@@ -287,6 +365,7 @@ struct rs {
 
 	int			buffer_pkts;		//!< Size of the ring buffer to setup for live capture.
 	uint64_t		limit;			//!< Maximum number of packets to capture
+	int			threads;		//!< Number of threads to capture with.
 
 	struct {
 		int			interval;		//!< Time between stats updates in seconds.
@@ -300,8 +379,21 @@ struct rs {
 		rs_stats_tmpl_t		*tmpl;			//!< The stats templates we created on startup.
 #endif
 	} stats;
+
+	struct {
+		char const		*file;			//!< Write OpenMetrics to this file every interval.
+		char const		*listen;		//!< Serve OpenMetrics over HTTP on this [address:]port.
+		int			sockfd;			//!< HTTP listen socket.
+		char			*text;			//!< OpenMetrics for the last interval.
+	} metrics;
 };
 
+/*
+ *	openmetrics.c - OpenMetrics output
+ */
+int rs_stats_openmetrics_open(rs_t *conf, fr_event_list_t *el);
+void rs_stats_openmetrics_do_stats(rs_t *conf, rs_stats_t *stats, int const *codes, size_t num_codes);
+
 #ifdef HAVE_COLLECTDC_H
 
 /** Callback for processing stats values.
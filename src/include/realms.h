@@ -141,7 +141,7 @@ typedef struct home_server {
 #ifdef WITH_STATS
 	int			number;
 
-	fr_stats_t		stats;
+	uint32_t		stats_id;	//!< Of the home server's counters, see radius_stats_local().
 
 	fr_stats_ema_t  	ema;
 #endif
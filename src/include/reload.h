@@ -0,0 +1,60 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_RELOAD_H
+#define _FR_RELOAD_H
+/**
+ * $Id$
+ *
+ * @file include/reload.h
+ * @brief Reload data read from a file, without blocking the threads which use it.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSIDH(reload_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_reload_t fr_reload_t;
+
+/** Read a file, and build the data the module looks things up in
+ *
+ * Called from the reload thread, so it must not use any thread's data.
+ *
+ * @param[in] ctx	to allocate the data in.  Everything the data needs
+ *			must be allocated in this context, as it's freed
+ *			when the data is replaced.
+ * @param[in] filename	to read.
+ * @param[in] uctx	passed to fr_reload_alloc().
+ * @param[out] entries	the number of entries which were read.
+ * @return
+ *	- The new data.
+ *	- NULL on error.
+ */
+typedef void *(*fr_reload_load_t)(TALLOC_CTX *ctx, char const *filename, void *uctx, uint64_t *entries);
+
+fr_reload_t	*fr_reload_alloc(TALLOC_CTX *ctx, char const *name, char const *filename,
+				 struct timeval const *interval, fr_reload_load_t load, void *uctx);
+
+void const	*fr_reload_enter(fr_reload_t *reload, uint64_t *generation);
+
+void		fr_reload_leave(fr_reload_t *reload);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_RELOAD_H */
@@ -0,0 +1,49 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_STARTUP_TRACE_H
+#define _FR_STARTUP_TRACE_H
+/**
+ * $Id$
+ *
+ * @file include/startup_trace.h
+ * @brief Record how long each phase of server startup takes.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSIDH(startup_trace_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_startup_phase_t fr_startup_phase_t;
+
+int			fr_startup_trace_init(char const *filename);
+
+bool			fr_startup_trace_enabled(void);
+
+fr_startup_phase_t	*fr_startup_trace_start(char const *phase, char const *fmt, ...);
+
+void			fr_startup_trace_stop(fr_startup_phase_t *p);
+
+void			fr_startup_trace_memory_stop(void);
+
+int			fr_startup_trace_report(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_STARTUP_TRACE_H */
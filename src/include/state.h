@@ -33,6 +33,40 @@ extern "C" {
 typedef struct fr_state_tree_t fr_state_tree_t;
 extern fr_state_tree_t *global_state;
 
+/** Length of the key identifying a state entry
+ *
+ */
+#define FR_STATE_KEY_LEN	(16)
+
+/** Copies state entries to storage shared with other servers
+ *
+ * Registered by a module, with #fr_state_backend_register.  The callbacks
+ * are called just before the reply is sent, so they must not block.
+ */
+typedef struct {
+	/** Save a copy of an entry
+	 *
+	 * @param[in] request	which created the entry.
+	 * @param[in] key	of the entry.
+	 * @param[in] data	the &session-state VALUE_PAIRs, as a binary detail record.
+	 * @param[in] data_len	length of the data.
+	 * @param[in] ttl	after which the copy is no longer needed, in seconds.
+	 * @param[in] uctx	from the backend.
+	 */
+	void	(*store)(REQUEST *request, uint8_t const *key, uint8_t const *data, size_t data_len,
+			 uint32_t ttl, void *uctx);
+
+	/** Remove the copy of an entry
+	 *
+	 * @param[in] request	which finished with the entry.
+	 * @param[in] key	of the entry.
+	 * @param[in] uctx	from the backend.
+	 */
+	void	(*discard)(REQUEST *request, uint8_t const *key, void *uctx);
+
+	void	*uctx;				//!< Passed to the callbacks.
+} fr_state_backend_t;
+
 fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint32_t timeout);
 
 void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *original);
@@ -40,6 +74,13 @@ void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *o
 void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet);
 bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *original, RADIUS_PACKET *packet);
 
+/*
+ *	Shared state
+ */
+int fr_state_backend_register(fr_state_backend_t const *backend);
+bool fr_state_missed(fr_state_tree_t *state, uint8_t *key, REQUEST *request);
+int fr_state_restore(fr_state_tree_t *state, REQUEST *request, uint8_t const *data, size_t data_len);
+
 /*
  *	Stats
  */
@@ -61,25 +61,32 @@ typedef struct fr_stats_ema_t {
 	uint32_t	ema1, ema10;
 } fr_stats_ema_t;
 
-extern fr_stats_t	radius_auth_stats;
-#ifdef WITH_ACCOUNTING
-extern fr_stats_t	radius_acct_stats;
-#endif
-#ifdef WITH_COA
-extern fr_stats_t	radius_coa_stats;
-extern fr_stats_t	radius_dsc_stats;
-#endif
+/** Which of a thing's counters to use
+ *
+ */
+typedef enum radius_stats_type_t {
+	RADIUS_STATS_AUTH = 0,				//!< Access-Request.
+	RADIUS_STATS_ACCT,				//!< Accounting-Request.
+	RADIUS_STATS_COA,				//!< CoA-Request.
+	RADIUS_STATS_DSC,				//!< Disconnect-Request.
+	RADIUS_STATS_TYPE_MAX
+} radius_stats_type_t;
+
+/*
+ *	For FR_STATS_INC(auth, ...)
+ */
+#define RADIUS_STATS_TYPE_auth	RADIUS_STATS_AUTH
+#define RADIUS_STATS_TYPE_acct	RADIUS_STATS_ACCT
+#define RADIUS_STATS_TYPE_coa	RADIUS_STATS_COA
+#define RADIUS_STATS_TYPE_dsc	RADIUS_STATS_DSC
+
+extern uint32_t		radius_stats_server;	//!< ID of the counters for all requests we receive.
 #ifdef WITH_PROXY
-extern fr_stats_t	proxy_auth_stats;
-#ifdef WITH_ACCOUNTING
-extern fr_stats_t	proxy_acct_stats;
-#endif
-#ifdef WITH_COA
-extern fr_stats_t	proxy_coa_stats;
-extern fr_stats_t	proxy_dsc_stats;
-#endif
+extern uint32_t		radius_stats_proxy;	//!< ID of the counters for all requests we proxy.
 #endif
 
+fr_stats_t *radius_stats_local(uint32_t *id, radius_stats_type_t type) CC_HINT(nonnull);
+void radius_stats_read(fr_stats_t *out, uint32_t const *id, radius_stats_type_t type) CC_HINT(nonnull);
 void radius_stats_init(int flag);
 void request_stats_final(REQUEST *request);
 void radius_stats_ema(fr_stats_ema_t *ema,
@@ -89,8 +96,12 @@ int fr_snmp_process(REQUEST *request);
 int fr_snmp_init(void);
 
 
-#define FR_STATS_INC(_x, _y) radius_ ## _x ## _stats._y++;if (listener) listener->stats._y++;if (client) client->_x._y++;
-#define FR_STATS_TYPE_INC(_x) _x++
+#define FR_STATS_INC(_x, _y) do { \
+	radius_stats_local(&radius_stats_server, RADIUS_STATS_TYPE_ ## _x)->_y++; \
+	if (listener) radius_stats_local(&listener->stats_id, RADIUS_STATS_TYPE_ ## _x)->_y++; \
+	if (client) radius_stats_local(&client->stats_id, RADIUS_STATS_TYPE_ ## _x)->_y++; \
+} while (0)
+#define FR_STATS_TYPE_INC(_id, _x, _y) radius_stats_local(&(_id), RADIUS_STATS_TYPE_ ## _x)->_y++
 
 #else  /* WITH_STATS */
 #define request_stats_init(_x)
@@ -98,7 +109,7 @@ int fr_snmp_init(void);
 #define fr_stats_bins(_x, _y, _z)
 
 #define FR_STATS_INC(_x, _y)
-#define FR_STATS_TYPE_INC(_x)
+#define FR_STATS_TYPE_INC(_id, _x, _y)
 
 #endif
 
@@ -0,0 +1,56 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_TRIE_H
+#define _FR_TRIE_H
+/**
+ * $Id$
+ *
+ * @file include/trie.h
+ * @brief Longest prefix match of IP addresses.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSIDH(trie_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_trie_t fr_trie_t;
+
+typedef struct fr_trie_leaf_t fr_trie_leaf_t;
+
+/** The prefix a lookup has got to
+ *
+ */
+typedef fr_trie_leaf_t const *fr_trie_cursor_t;
+
+fr_trie_t	*fr_trie_alloc(TALLOC_CTX *ctx);
+
+int		fr_trie_insert(fr_trie_t *trie, fr_ipaddr_t const *prefix, void *data);
+
+void		*fr_trie_exact(fr_trie_t const *trie, fr_ipaddr_t const *prefix);
+
+int		fr_trie_compile(fr_trie_t *trie);
+
+void		*fr_trie_find(fr_trie_t const *trie, fr_trie_cursor_t *cursor, fr_ipaddr_t const *ipaddr);
+
+void		*fr_trie_next(fr_trie_cursor_t *cursor);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_TRIE_H */
@@ -39,6 +39,31 @@ extern "C" {
 #define UDP_FLAGS_CONNECTED	(1 << 0)
 #define UDP_FLAGS_PEEK		(1 << 1)
 
+/*
+ *	The maximum number of datagrams for one call to
+ *	udp_recv_batch() or udp_send_batch().
+ */
+#define UDP_BATCH_MAX		(64)
+
+/** One datagram for udp_recv_batch() and udp_send_batch()
+ *
+ */
+typedef struct udp_datagram_t {
+	uint8_t			*data;		//!< Packet data.
+	size_t			data_len;	//!< Size of the buffer on receive.  Size of the packet
+						//!< on send, and after receive.  Zero if the packet
+						//!< should be ignored.
+
+	fr_ipaddr_t		src_ipaddr;	//!< Source IP address.
+	uint16_t		src_port;	//!< Source port.
+	fr_ipaddr_t		dst_ipaddr;	//!< Destination IP address.
+	uint16_t		dst_port;	//!< Destination port.
+	int			if_index;	//!< Interface the packet was received on, or will be
+						//!< sent from.
+
+	struct timeval		when;		//!< When the packet was received.
+} udp_datagram_t;
+
 ssize_t udp_send(int sockfd, void *data, size_t data_len, int flags,
 		 fr_ipaddr_t *src_ipaddr, uint16_t src_port, int if_index,
 		 fr_ipaddr_t *dst_ipaddr, uint16_t dst_port);
@@ -52,6 +77,10 @@ ssize_t udp_recv(int sockfd, void *data, size_t data_len, int flags,
 		 fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
 		 struct timeval *when);
 
+int udp_recv_batch(int sockfd, udp_datagram_t *dg, int num);
+
+int udp_send_batch(int sockfd, udp_datagram_t *dg, int num);
+
 #ifdef __cplusplus
 }
 #endif
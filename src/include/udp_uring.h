@@ -0,0 +1,47 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_UDP_URING_H
+#define _FR_UDP_URING_H
+/**
+ * $Id$
+ *
+ * @file include/udp_uring.h
+ * @brief Send and receive batches of UDP datagrams via io_uring.
+ *
+ * @copyright 2017  The FreeRADIUS server project
+ */
+RCSIDH(udp_uring_h, "$Id$")
+
+#include <freeradius-devel/udp.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct udp_uring_t udp_uring_t;
+
+udp_uring_t	*udp_uring_alloc(TALLOC_CTX *ctx, int sockfd, int num, size_t size);
+
+int		udp_uring_fd(udp_uring_t const *ur);
+
+int		udp_uring_recv(udp_uring_t *ur, udp_datagram_t *dg, int num);
+
+int		udp_uring_send(udp_uring_t *ur, udp_datagram_t *dg, int num);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_UDP_URING_H */
@@ -32,7 +32,15 @@ extern "C" {
 #endif
 
 #ifdef WITH_UDPFROMTO
+/** Enough space for the control data used by recvfromto_cmsg() and sendfromto_cmsg()
+ */
+#define UDPFROMTO_CMSG_SPACE	(128)
+
 int udpfromto_init(int s);
+void recvfromto_cmsg(struct msghdr *msgh, struct sockaddr *to, socklen_t *to_len,
+		     int *if_index, struct timeval *when);
+void sendfromto_cmsg(struct msghdr *msgh, void *cbuf, size_t cbuf_len,
+		     struct sockaddr *from, int if_index);
 int recvfromto(int s, void *buf, size_t len, int flags,
 	       struct sockaddr *from, socklen_t *fromlen,
 	       struct sockaddr *to, socklen_t *tolen,
@@ -59,7 +59,11 @@ typedef ssize_t (*xlat_func_t)(TALLOC_CTX *ctx, char **out, size_t outlen,
 
 /** Allocate new instance data for an xlat instance
  *
- * @param[out] xlat_inst Structure to populate. Allocated by #map_proc_instantiate.
+ * Called when the xlat is tokenized, if its argument contains no expansions.
+ * The instance data is then passed to every call of the #xlat_func_t for
+ * that expansion.  Otherwise the #xlat_func_t gets a NULL xlat_inst.
+ *
+ * @param[out] xlat_inst Structure to populate. Allocated by the xlat tokenizer.
  * @param[in] mod_inst Module instance that registered the #xlat_func_t.
  * @param[in] fmt string to base instantiation around.
  * @return
@@ -84,6 +88,10 @@ ssize_t xlat_aeval_compiled(TALLOC_CTX *ctx, char **out, REQUEST *request,
 			    xlat_exp_t const *xlat, xlat_escape_t escape, void const *escape_ctx)
 	CC_HINT(nonnull (2, 3, 4));
 
+int xlat_eval_compiled_box(TALLOC_CTX *ctx, fr_value_box_t *out, REQUEST *request,
+			   xlat_exp_t const *xlat, fr_type_t type)
+	CC_HINT(nonnull (2, 3, 4));
+
 ssize_t xlat_tokenize(TALLOC_CTX *ctx, char *fmt, xlat_exp_t **head, char const **error);
 
 size_t xlat_snprint(char *buffer, size_t bufsize, xlat_exp_t const *node);
@@ -95,6 +103,11 @@ int		xlat_register(void *mod_inst, char const *name,
 			      xlat_instantiate_t instantiate, size_t inst_size,
 			      size_t buf_len);
 
+int		xlat_register_pure(void *mod_inst, char const *name,
+				   xlat_func_t func, xlat_escape_t escape,
+				   xlat_instantiate_t instantiate, size_t inst_size,
+				   size_t buf_len);
+
 void		xlat_unregister(void *mod_inst, char const *name, xlat_func_t func);
 void		xlat_unregister_module(void *instance);
 int		xlat_register_redundant(CONF_SECTION *cs);
@@ -49,6 +49,37 @@ typedef void (*fr_app_process_set_t)(void const *instance, REQUEST *request);
  */
 typedef void (*fr_app_event_list_set_t)(void const *instance, fr_event_list_t *el);
 
+/** Create another instance of an I/O path, which shares the same address
+ *
+ * Used to open one socket for each network thread.  The new instance
+ * must be opened with fr_app_io_t.open.
+ *
+ * @param[out] shard	the new instance.
+ * @param[in] ctx	to allocate the new instance in.
+ * @param[in] instance	to copy.
+ * @return
+ *	- <0 on error.
+ *	- 0 if the instance is not configured for multiple sockets.
+ *	- 1 if a new instance was created.
+ */
+typedef int (*fr_app_io_shard_t)(void **shard, TALLOC_CTX *ctx, void const *instance);
+
+/** Accept a new connection on a listening socket
+ *
+ * The new instance is for the connection, and uses the same
+ * #fr_app_io_t functions as the listening socket.  It is already
+ * open, and MUST NOT block.
+ *
+ * @param[out] connection	the new instance.
+ * @param[in] ctx		to allocate the new instance in.
+ * @param[in] instance		of the listening socket.
+ * @return
+ *	- <0 on error.
+ *	- 0 if there was no connection to accept.
+ *	- 1 if a new connection was accepted.
+ */
+typedef int (*fr_app_io_accept_t)(void **connection, TALLOC_CTX *ctx, void const *instance);
+
 /** Describes a new application (protocol)
  *
  */
@@ -69,6 +100,9 @@ typedef struct {
 							///< Here for convenience, so that encode operations common
 							///< to all #fr_app_io_t can be performed by the #fr_app_t.
 	fr_app_process_set_t		process_set;
+
+	fr_io_prioritize_t		priority;	//!< Return the priority of a raw packet.  If not set,
+							///< all packets are #FR_IO_PRIORITY_NORMAL.
 } fr_app_t;
 
 /** Public structure describing an application (protocol) specialisation
@@ -95,9 +129,17 @@ typedef struct fr_app_io_t {
 	fr_app_instantiate_t		instantiate;
 	fr_app_event_list_set_t		event_list_set;	//!< Called by the network thread to pass an event list
 							//!< for use by the app_io_t.
+	fr_app_io_shard_t		shard;		//!< Create another instance for another network thread.
+							//!< May be NULL.
+	fr_app_io_accept_t		accept;		//!< Accept a new connection when the socket is readable,
+							//!< instead of reading from it.  May be NULL.
 
 	size_t				default_message_size;	// Usually minimum message size
 
+	uint32_t			max_reads;	//!< Maximum number of packets to read for one readiness
+							//!< event.  0 means one.  If set, read() MUST NOT block,
+							//!< and MUST return 0 when there is no more data.
+
 	fr_io_open_t			open;		//!< Open a new socket for listening, or accept/connect a new
 							//!< connection.
 	fr_io_get_fd_t			fd;		//!< Return the file descriptor from the instance.
@@ -105,9 +147,19 @@ typedef struct fr_app_io_t {
 	fr_io_data_write_t		write;		//!< Write from a data buffer to a socket
 	fr_io_decode_t			decode;		//!< Translate raw bytes into VALUE_PAIRs and metadata.
 	fr_io_encode_t			encode;		//!< Pack VALUE_PAIRs back into a byte array.
-	fr_io_signal_t			flush;		//!< Flush the data when the socket is ready for writing.
+	fr_io_signal_t			flush;		//!< Flush any queued writes.  Called after each batch of
+							//!< writes, and when the socket becomes writable.  Returns
+							//!< >0 if data is still queued.
+	fr_io_signal_t			pending;	//!< Returns >0 if the transport holds data which can be
+							//!< read without the socket becoming readable again,
+							//!< e.g. decrypted TLS records.  May be NULL.
 	fr_io_signal_t			error;		//!< There was an error on the socket.
 	fr_io_signal_t			close;		//!< Close the transport.
 	fr_io_nak_t			nak;		//!< Function to send a NAK.
+	fr_io_client_t			client;		//!< Return the client of a packet, for rate limiting.
+							//!< May be NULL.
+	fr_io_mirror_t			mirror;		//!< Copy the packet_ctx of a packet, so that it can be
+							//!< mirrored.  May be NULL, in which case the packets
+							//!< can't be mirrored.
 } fr_app_io_t;
 #endif
@@ -55,11 +55,16 @@ typedef struct fr_atomic_queue_entry_t {
 	atomic_int64_t seq;
 } fr_atomic_queue_entry_t;
 
+/*
+ *	The head is written by producers, and the tail by consumers.
+ *	Keep them on separate cache lines, so that the two sides don't
+ *	false-share.
+ */
 struct fr_atomic_queue_t {
 	alignas(128) atomic_int64_t head;
-	atomic_int64_t tail;
+	alignas(128) atomic_int64_t tail;
 
-	int	size;
+	alignas(128) int	size;
 
 	fr_atomic_queue_entry_t entry[1];
 };
@@ -242,6 +247,151 @@ bool fr_atomic_queue_pop(fr_atomic_queue_t *aq, void **p_data)
 	return true;
 }
 
+/** Push multiple pointers into the atomic queue
+ *
+ *  The slots are claimed with one update of the head.  If there isn't
+ *  room for all of the pointers, as many as fit are pushed, in order.
+ *
+ * @param[in] aq	The atomic queue to add data to.
+ * @param[in] data	array of pointers to push.  None may be NULL.
+ * @param[in] num	the number of pointers in the array.
+ * @return
+ *	- the number of pointers pushed, which may be less than "num".
+ *	- 0 on queue full.
+ */
+int fr_atomic_queue_push_n(fr_atomic_queue_t *aq, void **data, int num)
+{
+	int i, count;
+	int64_t head;
+
+	if (!data || (num <= 0)) return 0;
+
+	if (num > aq->size) num = aq->size;
+
+	head = load(aq->head);
+
+	for (;;) {
+		int64_t seq, diff = 0;
+
+		/*
+		 *	Count the free slots after the head.  A slot is
+		 *	free for position "head + i" when its sequence
+		 *	is "head + i".  Consumers may free slots out of
+		 *	order, so we stop at the first one which isn't
+		 *	free.
+		 */
+		for (count = 0; count < num; count++) {
+			seq = aquire(aq->entry[(head + count) % aq->size].seq);
+			diff = seq - (head + count);
+
+			if (diff != 0) break;
+		}
+
+		/*
+		 *	The first slot is in use, the queue is full.
+		 */
+		if ((count == 0) && (diff < 0)) return 0;
+
+		/*
+		 *	Someone else has pushed to the slots we looked
+		 *	at.  Get the new head pointer, and continue.
+		 */
+		if (count == 0) {
+			head = load(aq->head);
+			continue;
+		}
+
+		/*
+		 *	Claim all of the free slots at once.  On failure,
+		 *	"head" is updated with the current value.
+		 */
+		if (atomic_compare_exchange_strong_explicit(&aq->head, &head, head + count,
+							    memory_order_release, memory_order_relaxed)) {
+			break;
+		}
+	}
+
+	/*
+	 *	The slots are ours.  Fill them in, and then publish
+	 *	them to the consumers.
+	 */
+	for (i = 0; i < count; i++) {
+		aq->entry[(head + i) % aq->size].data = data[i];
+	}
+
+	for (i = 0; i < count; i++) {
+		store(aq->entry[(head + i) % aq->size].seq, head + i + 1);
+	}
+
+	return count;
+}
+
+
+/** Pop multiple pointers from the atomic queue
+ *
+ *  The slots are claimed with one update of the tail.
+ *
+ * @param[in] aq	the atomic queue to retrieve data from.
+ * @param[out] data	where to write the pointers.
+ * @param[in] num	the maximum number of pointers to pop.
+ * @return
+ *	- the number of pointers popped, which may be less than "num".
+ *	- 0 on queue empty.
+ */
+int fr_atomic_queue_pop_n(fr_atomic_queue_t *aq, void **data, int num)
+{
+	int i, count;
+	int64_t tail;
+
+	if (!data || (num <= 0)) return 0;
+
+	if (num > aq->size) num = aq->size;
+
+	tail = load(aq->tail);
+
+	for (;;) {
+		int64_t seq, diff = 0;
+
+		/*
+		 *	Count the slots after the tail which have been
+		 *	published.  Producers may publish out of order,
+		 *	so we stop at the first one which isn't ready.
+		 */
+		for (count = 0; count < num; count++) {
+			seq = aquire(aq->entry[(tail + count) % aq->size].seq);
+			diff = seq - (tail + count + 1);
+
+			if (diff != 0) break;
+		}
+
+		if ((count == 0) && (diff < 0)) return 0;
+
+		if (count == 0) {
+			tail = load(aq->tail);
+			continue;
+		}
+
+		if (atomic_compare_exchange_strong_explicit(&aq->tail, &tail, tail + count,
+							    memory_order_release, memory_order_relaxed)) {
+			break;
+		}
+	}
+
+	/*
+	 *	Copy the pointers to the caller BEFORE marking the
+	 *	slots as unused.
+	 */
+	for (i = 0; i < count; i++) {
+		data[i] = aq->entry[(tail + i) % aq->size].data;
+	}
+
+	for (i = 0; i < count; i++) {
+		store(aq->entry[(tail + i) % aq->size].seq, tail + i + aq->size);
+	}
+
+	return count;
+}
+
 #ifndef NDEBUG
 
 #if 0
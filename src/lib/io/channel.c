@@ -28,6 +28,7 @@ RCSID("$Id$")
 #include <freeradius-devel/io/control.h>
 #include <freeradius-devel/fr_log.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/probe.h>
 
 /*
  *	Debugging, mainly for channel_test
@@ -100,6 +101,13 @@ typedef struct fr_channel_end_t {
 
 	size_t			num_kevents;	//!< Number of times we've looked at kevents.
 
+	size_t			num_coalesced;	//!< Number of signals merged into a pending signal.
+
+	bool			batch;		//!< Defer signals until fr_channel_*_flush() is called.
+	bool			signal_pending;	//!< We have a deferred signal to send.
+	fr_channel_signal_t	pending_signal;	//!< The deferred signal.
+	fr_time_t		pending_when;	//!< When the deferred signal was queued.
+
 	uint64_t		sequence;	//!< Sequence number for this channel.
 	uint64_t		ack;		//!< Sequence number of the other end.
 	uint64_t		their_view_of_my_sequence;	//!< Should be clear.
@@ -239,6 +247,57 @@ static int fr_channel_data_ready(fr_channel_t *ch, fr_time_t when, fr_channel_en
 	return fr_control_message_send(end->control, end->rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc));
 }
 
+/** Signal that data is ready, or defer the signal
+ *
+ * When the channel end is in batch mode, and messages are arriving
+ * faster than SIGNAL_INTERVAL, we don't signal the other end for
+ * each message.  Instead, we remember that a signal is needed, and
+ * send one signal for the whole burst when the owner of this end
+ * calls fr_channel_master_flush() or fr_channel_worker_flush().
+ *
+ * When messages arrive slowly, the signal is sent immediately, so
+ * that we don't add latency.
+ *
+ * @param[in] ch	the channel.
+ * @param[in] when	the data was ready.  Typically taken from the message.
+ * @param[in] end	of the channel that the message was written to.
+ * @param[in] which	end of the channel (0/1).
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int fr_channel_data_ready_batch(fr_channel_t *ch, fr_time_t when, fr_channel_end_t *end, fr_channel_signal_t which)
+{
+	if (!end->batch || (end->message_interval >= SIGNAL_INTERVAL)) {
+		return fr_channel_data_ready(ch, when, end, which);
+	}
+
+	if (end->signal_pending) end->num_coalesced++;
+
+	end->signal_pending = true;
+	end->pending_signal = which;
+	end->pending_when = when;
+
+	return 0;
+}
+
+/** Send any deferred signal for one end of the channel
+ *
+ * @param[in] ch	the channel.
+ * @param[in] end	of the channel to flush.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int fr_channel_flush(fr_channel_t *ch, fr_channel_end_t *end)
+{
+	if (!end->signal_pending) return 0;
+
+	end->signal_pending = false;
+
+	return fr_channel_data_ready(ch, end->pending_when, end, end->pending_signal);
+}
+
 #define IALPHA (8)
 #define RTT(_old, _new) ((_new + ((IALPHA - 1) * _old)) / IALPHA)
 
@@ -284,6 +343,8 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_
 	master->sequence = sequence;
 	message_interval = when - master->last_write;
 
+	FR_PROBE3(channel_send_request, ch, sequence, when);
+
 	if (!master->message_interval) {
 		master->message_interval = message_interval;
 	} else {
@@ -329,7 +390,7 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_
 	 *	Tell the other end that there is new data ready.
 	 */
 	MPRINT("MASTER SIGNALS\n");
-	return fr_channel_data_ready(ch, when, master, FR_CHANNEL_SIGNAL_DATA_TO_WORKER);
+	return fr_channel_data_ready_batch(ch, when, master, FR_CHANNEL_SIGNAL_DATA_TO_WORKER);
 }
 
 /** Receive a reply message from the channel
@@ -487,7 +548,7 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_da
 	 *	thread.
 	 */
 	if (worker->num_outstanding == 0) {
-		return fr_channel_data_ready(ch, when, worker, FR_CHANNEL_SIGNAL_DATA_DONE_WORKER);
+		return fr_channel_data_ready_batch(ch, when, worker, FR_CHANNEL_SIGNAL_DATA_DONE_WORKER);
 	}
 
 	MPRINT("\twhen - last_read_other = %zd - %zd = %zd\n", when, worker->last_read_other, when - worker->last_read_other);
@@ -526,7 +587,7 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_da
 #endif
 
 	MPRINT("\tWORKER SIGNALS num_outstanding %zd\n", worker->num_outstanding);
-	return fr_channel_data_ready(ch, when, worker, FR_CHANNEL_SIGNAL_DATA_FROM_WORKER);
+	return fr_channel_data_ready_batch(ch, when, worker, FR_CHANNEL_SIGNAL_DATA_FROM_WORKER);
 }
 
 
@@ -547,6 +608,11 @@ int fr_channel_worker_sleeping(fr_channel_t *ch)
 
 	worker = &(ch->end[FROM_WORKER]);
 
+	/*
+	 *	Any deferred signal has to go out before we sleep.
+	 */
+	if (fr_channel_flush(ch, worker) < 0) return -1;
+
 	/*
 	 *	We don't have any outstanding requests to process for
 	 *	this channel, don't signal the network thread that
@@ -705,6 +771,30 @@ bool fr_channel_active(fr_channel_t *ch)
 	return ch->active;
 }
 
+/** Get the number of requests on a channel which haven't been replied to
+ *
+ *  Called only from the master (i.e. network) side.
+ *
+ * @param[in] ch the channel
+ * @return the number of outstanding requests.
+ */
+int fr_channel_num_outstanding(fr_channel_t *ch)
+{
+	return ch->end[TO_WORKER].num_outstanding;
+}
+
+/** Get the number of requests on a channel which haven't been replied to
+ *
+ *  Called only from the worker side.
+ *
+ * @param[in] ch the channel
+ * @return the number of outstanding requests.
+ */
+int fr_channel_worker_num_outstanding(fr_channel_t *ch)
+{
+	return ch->end[FROM_WORKER].num_outstanding;
+}
+
 /** Signal a worker that the channel is closing
  *
  * @param[in] ch	The channel.
@@ -799,6 +889,64 @@ void *fr_channel_master_ctx_get(fr_channel_t *ch)
 }
 
 
+/** Enable or disable batched signals from the master
+ *
+ * When enabled, the master MUST call fr_channel_master_flush() before
+ * it waits for events.  Usually once per event loop pass.
+ *
+ * @param[in] ch	The channel.
+ * @param[in] batch	whether or not to batch signals.
+ */
+void fr_channel_master_batch_set(fr_channel_t *ch, bool batch)
+{
+	(void) talloc_get_type_abort(ch, fr_channel_t);
+
+	ch->end[TO_WORKER].batch = batch;
+}
+
+
+/** Enable or disable batched signals from the worker
+ *
+ * When enabled, the worker MUST call fr_channel_worker_flush() before
+ * it waits for events.  Usually once per event loop pass.
+ *
+ * @param[in] ch	The channel.
+ * @param[in] batch	whether or not to batch signals.
+ */
+void fr_channel_worker_batch_set(fr_channel_t *ch, bool batch)
+{
+	(void) talloc_get_type_abort(ch, fr_channel_t);
+
+	ch->end[FROM_WORKER].batch = batch;
+}
+
+
+/** Send any deferred "data ready" signal to the worker
+ *
+ * @param[in] ch	The channel.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_channel_master_flush(fr_channel_t *ch)
+{
+	return fr_channel_flush(ch, &ch->end[TO_WORKER]);
+}
+
+
+/** Send any deferred "data ready" signal to the master
+ *
+ * @param[in] ch	The channel.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_channel_worker_flush(fr_channel_t *ch)
+{
+	return fr_channel_flush(ch, &ch->end[FROM_WORKER]);
+}
+
+
 /** Send a channel to a worker
  *
  * @param[in] ch	The channel.
@@ -822,13 +970,17 @@ void fr_channel_debug(fr_channel_t *ch, FILE *fp)
 	fprintf(fp, "to worker\n");
 	fprintf(fp, "\tnum_signals sent = %zu\n", ch->end[TO_WORKER].num_signals);
 	fprintf(fp, "\tnum_signals re-sent = %zu\n", ch->end[TO_WORKER].num_resignals);
+	fprintf(fp, "\tnum_signals coalesced = %zu\n", ch->end[TO_WORKER].num_coalesced);
 	fprintf(fp, "\tnum_kevents checked = %zu\n", ch->end[TO_WORKER].num_kevents);
+	fprintf(fp, "\tnum_packets sent = %"PRIu64"\n", ch->end[TO_WORKER].num_packets);
 	fprintf(fp, "\tsequence = %"PRIu64"\n", ch->end[TO_WORKER].sequence);
 	fprintf(fp, "\tack = %"PRIu64"\n", ch->end[TO_WORKER].ack);
 
 	fprintf(fp, "to receive\n");
 	fprintf(fp, "\tnum_signals sent = %zu\n", ch->end[FROM_WORKER].num_signals);
+	fprintf(fp, "\tnum_signals coalesced = %zu\n", ch->end[FROM_WORKER].num_coalesced);
 	fprintf(fp, "\tnum_kevents checked = %zu\n", ch->end[FROM_WORKER].num_kevents);
+	fprintf(fp, "\tnum_packets sent = %"PRIu64"\n", ch->end[FROM_WORKER].num_packets);
 	fprintf(fp, "\tsequence = %"PRIu64"\n", ch->end[FROM_WORKER].sequence);
 	fprintf(fp, "\tack = %"PRIu64"\n", ch->end[FROM_WORKER].ack);
 }
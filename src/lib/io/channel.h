@@ -95,6 +95,7 @@ typedef struct fr_channel_data_t {
 	union {
 		struct {
 			fr_time_t		*recv_time;	//!< time original request was received (network -> worker)
+			fr_time_t		deadline;	//!< when the request is no longer useful, or 0 for none
 			fr_dlist_t		list;		//!< list of unprocessed packets for the worker
 		} request;
 
@@ -112,6 +113,8 @@ typedef struct fr_channel_data_t {
 								//!< that needs to be passed to the request.
 
 	fr_listen_t const *listen;				//!< for tracking packet transport, etc.
+
+	struct fr_trace_t *trace;				//!< if this request is being traced, or NULL
 } fr_channel_data_t;
 
 fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *master, fr_control_t *worker) CC_HINT(nonnull);
@@ -128,9 +131,16 @@ int fr_channel_service_kevent(fr_channel_t *ch, fr_control_t *c, struct kevent c
 fr_channel_event_t fr_channel_service_message(fr_time_t when, fr_channel_t **p_channel, void const *data, size_t data_size) CC_HINT(nonnull);
 
 bool fr_channel_active(fr_channel_t *ch) CC_HINT(nonnull);
+int fr_channel_num_outstanding(fr_channel_t *ch) CC_HINT(nonnull);
+int fr_channel_worker_num_outstanding(fr_channel_t *ch) CC_HINT(nonnull);
 
 int fr_channel_signal_open(fr_channel_t *ch) CC_HINT(nonnull);
 
+void fr_channel_master_batch_set(fr_channel_t *ch, bool batch) CC_HINT(nonnull);
+void fr_channel_worker_batch_set(fr_channel_t *ch, bool batch) CC_HINT(nonnull);
+int fr_channel_master_flush(fr_channel_t *ch) CC_HINT(nonnull);
+int fr_channel_worker_flush(fr_channel_t *ch) CC_HINT(nonnull);
+
 int fr_channel_signal_worker_close(fr_channel_t *ch) CC_HINT(nonnull);
 int fr_channel_worker_ack_close(fr_channel_t *ch) CC_HINT(nonnull);
 
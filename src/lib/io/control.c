@@ -27,6 +27,7 @@ RCSID("$Id$")
 #include <freeradius-devel/io/control.h>
 #include <freeradius-devel/io/ring_buffer.h>
 #include <freeradius-devel/fr_log.h>
+#include <freeradius-devel/event.h>
 
 #include <string.h>
 #include <sys/event.h>
@@ -96,7 +97,9 @@ struct fr_control_t {
 fr_control_t *fr_control_create(TALLOC_CTX *ctx, int kq, fr_atomic_queue_t *aq, uintptr_t ident)
 {
 	fr_control_t *c;
+#ifndef WITH_EVENT_EPOLL
 	struct kevent kev;
+#endif
 
 	c = talloc_zero(ctx, fr_control_t);
 	if (!c) {
@@ -119,13 +122,18 @@ fr_control_t *fr_control_create(TALLOC_CTX *ctx, int kq, fr_atomic_queue_t *aq,
 	 *
 	 *	The implementation here is perhaps a bit less optimal,
 	 *	but it's clean, and it works.
+	 *
+	 *	With epoll, the ident is an eventfd which
+	 *	fr_event_user_insert() has already registered.
 	 */
+#ifndef WITH_EVENT_EPOLL
 	EV_SET(&kev, ident, EVFILT_USER, EV_ADD | EV_CLEAR, NOTE_FFNOP, 0, NULL);
 	if (kevent(c->kq, &kev, 1, NULL, 0, NULL) < 0) {
 		talloc_free(c);
 		fr_strerror_printf("Failed opening KQ for control socket: %s", fr_syserror(errno));
 		return NULL;
 	}
+#endif
 
 	return c;
 }
@@ -190,15 +198,18 @@ int fr_control_gc(UNUSED fr_control_t *c, fr_ring_buffer_t *rb)
  */
 void fr_control_free(fr_control_t *c)
 {
+#ifndef WITH_EVENT_EPOLL
 	struct kevent kev;
+#endif
 
 	(void) talloc_get_type_abort(c, fr_control_t);
 
+#ifndef WITH_EVENT_EPOLL
 	EV_SET(&kev, c->ident, EVFILT_USER, EV_DELETE, NOTE_FFNOP, 0, NULL);
 	if (kevent(c->kq, &kev, 1, NULL, 0, NULL) < 0) {
-		talloc_free(c);
 		fr_strerror_printf("Failed opening KQ for control socket: %s", fr_syserror(errno));
 	}
+#endif
 
 	talloc_free(c);
 }
@@ -308,19 +319,11 @@ int fr_control_message_push(fr_control_t *c, fr_ring_buffer_t *rb, uint32_t id,
  */
 int fr_control_message_send(fr_control_t *c, fr_ring_buffer_t *rb, uint32_t id, void *data, size_t data_size)
 {
-	int rcode;
-	struct kevent kev;
-
 	(void) talloc_get_type_abort(c, fr_control_t);
 
 	if (fr_control_message_push(c, rb, id, data, data_size) < 0) return -1;
 
-	EV_SET(&kev, c->ident, EVFILT_USER, 0, NOTE_TRIGGER | NOTE_FFNOP, 0, NULL);
-	rcode = kevent(c->kq, &kev, 1, NULL, 0, NULL);
-	if (rcode >= 0) return rcode;
-
-	fr_strerror_printf("Failed sending user event to kqueue (%i): %s", c->kq, fr_syserror(errno));
-	return rcode;
+	return fr_event_user_trigger(c->kq, c->ident);
 }
 
 
@@ -56,6 +56,19 @@ typedef	void (*fr_control_callback_t)(void *ctx, void const *data, size_t data_s
 #define FR_CONTROL_ID_CHANNEL (1)
 #define FR_CONTROL_ID_SOCKET  (2)
 #define FR_CONTROL_ID_WORKER  (3)
+#define FR_CONTROL_ID_WORKER_DELETE (4)
+#define FR_CONTROL_ID_STATS   (5)
+
+/** Ask a network or worker thread for a snapshot of its statistics
+ *
+ *  The receiving thread fills in "stats", and then calls "done".
+ *  "stats" has to stay valid until then.
+ */
+typedef struct fr_control_stats_t {
+	void		*stats;			//!< where the statistics are written
+	void		(*done)(void *uctx);	//!< called by the receiving thread when it's finished
+	void		*uctx;			//!< passed to done()
+} fr_control_stats_t;
 
 fr_control_t *fr_control_create(TALLOC_CTX *ctx, int kq, fr_atomic_queue_t *aq, uintptr_t ident) CC_HINT(nonnull(3));
 void fr_control_free(fr_control_t *c) CC_HINT(nonnull);
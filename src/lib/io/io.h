@@ -56,6 +56,18 @@ typedef enum fr_io_final_t {
 	FR_IO_DONE,		//!< succeeded without a reply
 } fr_io_final_t;
 
+/**
+ *  Packet priorities.  Lower numbers are processed first, and are the
+ *  last to be dropped when the workers are overloaded.
+ */
+typedef enum fr_io_priority_t {
+	FR_IO_PRIORITY_HIGH = 0,	//!< e.g. Status-Server.  Never dropped for load.
+	FR_IO_PRIORITY_NORMAL,		//!< e.g. Access-Request
+	FR_IO_PRIORITY_LOW,		//!< e.g. Accounting Start / Stop
+	FR_IO_PRIORITY_BACKGROUND,	//!< e.g. Accounting Interim-Update.  Dropped first.
+	FR_IO_PRIORITY_MAX
+} fr_io_priority_t;
+
 typedef struct fr_channel_t fr_channel_t;
 
 /**  Open an I/O path
@@ -104,6 +116,49 @@ typedef int (*fr_io_get_fd_t)(void const *instance);
  */
 typedef int (*fr_io_decode_t)(void const *instance, REQUEST *request, uint8_t *const data, size_t data_len);
 
+/** Return the priority of a raw packet.
+ *
+ *  Called by the network thread for every packet it reads, before the
+ *  packet is sent to a worker.  It should look at as little of the
+ *  packet as possible, and MUST NOT decode it.
+ *
+ * @param[in] instance		of the #fr_app_t.
+ * @param[in] data		the raw packet data
+ * @param[in] data_len		the length of the raw data
+ * @return the priority of the packet.
+ */
+typedef fr_io_priority_t (*fr_io_prioritize_t)(void const *instance, uint8_t const *data, size_t data_len);
+
+/** Return the client a packet came from
+ *
+ *  Called by the network thread for every packet it reads, to find
+ *  the client's rate limits.  It MUST NOT look at the packet data.
+ *
+ * @param[in] instance		of the #fr_app_io_t.
+ * @param[in] packet_ctx	as returned by the read() function.
+ * @return
+ *	- the client.
+ *	- NULL if the transport doesn't know.
+ */
+typedef RADCLIENT *(*fr_io_client_t)(void const *instance, void const *packet_ctx);
+
+/** Copy the packet_ctx of a packet, for a mirrored copy of the packet
+ *
+ *  Called by the network thread when a packet is mirrored to a shadow
+ *  virtual server.  The copy MUST be usable by the decode() and
+ *  client() functions, and MUST NOT share anything with the original
+ *  which the write() function changes or frees.  The network thread
+ *  frees the copy when the mirrored request is done.
+ *
+ * @param[in] ctx		to allocate the copy in.
+ * @param[in] instance		of the #fr_app_io_t.
+ * @param[in] packet_ctx	as returned by the read() function.
+ * @return
+ *	- the copy.
+ *	- NULL on error.
+ */
+typedef void *(*fr_io_mirror_t)(TALLOC_CTX *ctx, void const *instance, void const *packet_ctx);
+
 /** Encode data from a REQUEST into a raw packet.
  *
  *  This function is the opposite of fr_io_decode_t.
@@ -32,8 +32,25 @@ struct fr_listen {
 
 	CONF_SECTION		*server_cs;		//!< CONF_SECTION of the server
 
+	fr_listen_t const	*parent;		//!< The listener this connection was accepted on,
+							///< or NULL for listening sockets.
+
+	char const		*name;			//!< For statistics, e.g. "default/radius_udp/1812".
+							///< May be NULL.
+
 	size_t			default_message_size;	//!< copied from app_io, but may be changed
 	size_t			num_messages;		//!< for the message ring buffer
+
+	fr_time_t		deadline[FR_IO_PRIORITY_MAX];	//!< how long after it was received a packet of
+								///< each priority is still useful, or 0 for
+								///< no deadline.
+
+	fr_listen_t const	*mirror;		//!< Copies of sampled packets are sent to this
+							///< listener, or NULL.
+	uint32_t		mirror_sample;		//!< One packet in this many is mirrored.
+
+	bool			shadow;			//!< Packets are mirrored copies.  Their replies are
+							///< discarded, and modules with side effects aren't called.
 };
 
 /**
@@ -48,11 +65,29 @@ struct fr_async_t {
 	fr_io_process_t		process;
 	fr_time_tracking_t	tracking;
 	fr_channel_t		*channel;
+	struct fr_worker_steal_slot_t *stolen_from;	//!< the worker which owns "channel",
+							//!< if we stole this request from it.
 
 	uint32_t		priority;
+	fr_time_t		deadline;	//!< when the reply is no longer useful, or 0 for none
+	fr_time_t		cpu_budget;	//!< CPU time the request may use, or 0 for no limit.
 	void			*packet_ctx;
 	fr_listen_t const	*listen;	//!< How we received this request,
 						//!< and how we'll send the reply.
+
+	fr_message_t		*message;	//!< The message the packet was decoded from.  While this
+						///< is set, the decoder may point request->packet->data
+						///< at the message data instead of copying it.  The worker
+						///< copies it before releasing the message.
+
+	size_t			pool_size;	//!< of the talloc pool the request was allocated in
+
+	struct fr_trace_t	*trace;		//!< if this request is being traced, or NULL
+	int			trace_span;	//!< the "process" span of the trace
+
+	char const		*module;	//!< the module the request is running, or waiting for, or NULL.
+						///< Unlike request->module, this is kept while the module
+						///< has yielded.
 };
 
 /** Information to track src/dst ip/port
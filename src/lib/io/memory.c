@@ -0,0 +1,166 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Memory used by modules, caches, sessions and message sets.
+ * @file io/memory.c
+ *
+ * talloc can tell us how much memory is under a context, but walking
+ * a context isn't safe while another thread allocates in it.  So the
+ * memory is counted by whoever owns it.  Things which are only touched
+ * by one thread, such as the thread instance data of a module, are
+ * measured by that thread now and again, with fr_memory_update().
+ * Things which are shared, such as cache entries and session state,
+ * are measured when they're added, and again when they're removed,
+ * with fr_memory_add(), or fr_memory_reserve() if they can be refused.
+ *
+ * The counts are kept in metric sets, so they're printed along with
+ * the other metrics, and "show memory" can find them.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/io/memory.h>
+
+static fr_metric_t const memory_metrics[FR_MEMORY_METRIC_MAX] = {
+	[FR_MEMORY_USED] = { "freeradius_memory_bytes", NULL, FR_METRIC_GAUGE,
+			     "Memory in use, as counted by talloc." },
+	[FR_MEMORY_PEAK] = { "freeradius_memory_peak_bytes", NULL, FR_METRIC_GAUGE,
+			     "Most memory in use at once.  Where each thread counts its own, "
+			     "this is the sum of their peaks." },
+	[FR_MEMORY_ALLOCATED] = { "freeradius_memory_allocated_bytes", NULL, FR_METRIC_COUNTER,
+				  "Increases in the memory in use.  Its rate is the allocation rate." },
+	[FR_MEMORY_SOFT_LIMIT] = { "freeradius_memory_soft_limit_bytes", NULL, FR_METRIC_GAUGE,
+				   "Above this, memory is freed early, e.g. by evicting cache entries.  "
+				   "0 for no limit." },
+	[FR_MEMORY_HARD_LIMIT] = { "freeradius_memory_hard_limit_bytes", NULL, FR_METRIC_GAUGE,
+				   "Above this, new sessions or entries are refused.  0 for no limit." },
+};
+
+/** Allocate a memory set
+ *
+ * @param[in] ctx	to allocate the set in.  The set is no longer printed
+ *			once it's freed.
+ * @param[in] type	of thing the memory is used by, e.g. "module".
+ * @param[in] name	of the thing, e.g. "sql".
+ * @return
+ *	- NULL on error.
+ *	- the new set.
+ */
+fr_memory_t *fr_memory_alloc(TALLOC_CTX *ctx, char const *type, char const *name)
+{
+	fr_memory_t *mem;
+
+	mem = fr_metric_set_alloc(ctx, memory_metrics, FR_MEMORY_METRIC_MAX, true);
+	if (!mem) return NULL;
+
+	if ((fr_metric_set_label(mem, "type", type) < 0) || (fr_metric_set_label(mem, "name", name) < 0)) {
+		talloc_free(mem);
+		return NULL;
+	}
+
+	return mem;
+}
+
+/** Set the limits
+ *
+ * The set doesn't enforce them.  The owner checks fr_memory_limit(),
+ * or uses fr_memory_reserve(), and decides what to do.
+ *
+ * @param[in] mem	the memory set.
+ * @param[in] soft	limit, or 0 for none.
+ * @param[in] hard	limit, or 0 for none.
+ */
+void fr_memory_limits(fr_memory_t *mem, size_t soft, size_t hard)
+{
+	atomic_store_explicit(&mem->value[FR_MEMORY_SOFT_LIMIT], soft, memory_order_relaxed);
+	atomic_store_explicit(&mem->value[FR_MEMORY_HARD_LIMIT], hard, memory_order_relaxed);
+}
+
+/** Raise the peak, if the memory in use is above it
+ *
+ */
+static inline void memory_peak(fr_memory_t *mem, uint64_t used)
+{
+	unsigned long long peak = atomic_load_explicit(&mem->value[FR_MEMORY_PEAK], memory_order_relaxed);
+
+	while ((used > peak) &&
+	       !atomic_compare_exchange_weak_explicit(&mem->value[FR_MEMORY_PEAK], &peak, used,
+						      memory_order_relaxed, memory_order_relaxed));
+}
+
+/** Count memory which is now in use, or which was freed
+ *
+ * @param[in] mem	the memory set.
+ * @param[in] bytes	which were added, or, if negative, freed.
+ */
+void fr_memory_add(fr_memory_t *mem, int64_t bytes)
+{
+	uint64_t used;
+
+	if (!bytes) return;
+
+	used = atomic_fetch_add_explicit(&mem->value[FR_MEMORY_USED], (uint64_t) bytes,
+					 memory_order_relaxed) + (uint64_t) bytes;
+	if (bytes < 0) return;
+
+	atomic_fetch_add_explicit(&mem->value[FR_MEMORY_ALLOCATED], (uint64_t) bytes, memory_order_relaxed);
+	memory_peak(mem, used);
+}
+
+/** Update the memory one owner has in a set
+ *
+ * For things which are measured now and again, by the thread which
+ * owns them.  Each owner keeps what it counted last time, so several
+ * owners can share a set.
+ *
+ * @param[in] mem	the memory set.
+ * @param[in,out] used	what the owner counted last time.  Updated to "size".
+ * @param[in] size	what the owner uses now.
+ */
+void fr_memory_update(fr_memory_t *mem, size_t *used, size_t size)
+{
+	fr_memory_add(mem, (int64_t) size - (int64_t) *used);
+	*used = size;
+}
+
+/** Count memory, unless it would take the set over its hard limit
+ *
+ * @param[in] mem	the memory set.
+ * @param[in] bytes	which are about to be used.
+ * @return
+ *	- true if the memory was counted.
+ *	- false if it would go over the hard limit.  Nothing is counted.
+ */
+bool fr_memory_reserve(fr_memory_t *mem, size_t bytes)
+{
+	unsigned long long used = atomic_load_explicit(&mem->value[FR_MEMORY_USED], memory_order_relaxed);
+	uint64_t hard = atomic_load_explicit(&mem->value[FR_MEMORY_HARD_LIMIT], memory_order_relaxed);
+
+	do {
+		if (hard && ((used + bytes) > hard)) return false;
+	} while (!atomic_compare_exchange_weak_explicit(&mem->value[FR_MEMORY_USED], &used, used + bytes,
+							memory_order_relaxed, memory_order_relaxed));
+
+	atomic_fetch_add_explicit(&mem->value[FR_MEMORY_ALLOCATED], bytes, memory_order_relaxed);
+	memory_peak(mem, used + bytes);
+
+	return true;
+}
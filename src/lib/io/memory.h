@@ -0,0 +1,100 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_MEMORY_H
+#define _FR_MEMORY_H
+/**
+ * $Id$
+ *
+ * @file io/memory.h
+ * @brief Memory used by modules, caches, sessions and message sets.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSIDH(memory_h, "$Id$")
+
+#include <freeradius-devel/io/metrics.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ *  The metrics in a memory set.
+ */
+typedef enum fr_memory_metric_t {
+	FR_MEMORY_USED = 0,			//!< bytes in use now.
+	FR_MEMORY_PEAK,				//!< most bytes in use at once.
+	FR_MEMORY_ALLOCATED,			//!< sum of the increases in use, for the allocation rate.
+	FR_MEMORY_SOFT_LIMIT,			//!< above which the owner frees what it can.  0 for none.
+	FR_MEMORY_HARD_LIMIT,			//!< above which the owner refuses to use more.  0 for none.
+	FR_MEMORY_METRIC_MAX
+} fr_memory_metric_t;
+
+/**
+ *  Which limit the memory in use is over.
+ */
+typedef enum fr_memory_limit_t {
+	FR_MEMORY_OK = 0,			//!< under both limits, or there are none.
+	FR_MEMORY_SOFT,				//!< over the soft limit.
+	FR_MEMORY_HARD				//!< over the hard limit.
+} fr_memory_limit_t;
+
+/**
+ *  The memory used by one thing, e.g. a module, or the message sets
+ *  of one worker.
+ *
+ *  It's a shared metric set, labelled with type="..." and name="...",
+ *  so it's printed with the other metrics.  Anything may add to it,
+ *  from any thread.  Sets with the same labels are added together
+ *  when they're printed, so each thread can have its own.
+ *
+ *  Memory is counted by whoever owns it, as talloc can only be asked
+ *  about a context by the thread which allocates in it.
+ */
+typedef fr_metric_set_t fr_memory_t;
+
+fr_memory_t	*fr_memory_alloc(TALLOC_CTX *ctx, char const *type, char const *name) CC_HINT(nonnull(2,3));
+void		fr_memory_limits(fr_memory_t *mem, size_t soft, size_t hard) CC_HINT(nonnull);
+void		fr_memory_add(fr_memory_t *mem, int64_t bytes) CC_HINT(nonnull);
+void		fr_memory_update(fr_memory_t *mem, size_t *used, size_t size) CC_HINT(nonnull);
+bool		fr_memory_reserve(fr_memory_t *mem, size_t bytes) CC_HINT(nonnull);
+
+/** Return the bytes in use
+ */
+static inline size_t fr_memory_used(fr_memory_t const *mem)
+{
+	return atomic_load_explicit(&mem->value[FR_MEMORY_USED], memory_order_relaxed);
+}
+
+/** Return which limit, if any, the memory in use is over
+ */
+static inline fr_memory_limit_t fr_memory_limit(fr_memory_t const *mem)
+{
+	uint64_t used = atomic_load_explicit(&mem->value[FR_MEMORY_USED], memory_order_relaxed);
+	uint64_t soft = atomic_load_explicit(&mem->value[FR_MEMORY_SOFT_LIMIT], memory_order_relaxed);
+	uint64_t hard = atomic_load_explicit(&mem->value[FR_MEMORY_HARD_LIMIT], memory_order_relaxed);
+
+	if (hard && (used >= hard)) return FR_MEMORY_HARD;
+	if (soft && (used >= soft)) return FR_MEMORY_SOFT;
+
+	return FR_MEMORY_OK;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FR_MEMORY_H */
@@ -79,6 +79,14 @@ RCSID("$Id$")
  *  progress.  It is better to have a few large buffers than many
  *  small ones.
  *
+ *  The set also tracks how much of it is still in use after each
+ *  cleanup.  That figure is (roughly) what is in flight, and a
+ *  decaying peak of it is used to size the arrays ahead of demand.
+ *  When the in-flight data fills most of the set, the next array is
+ *  allocated during cleanup, instead of waiting for the allocator to
+ *  run out of room.  When traffic drops, and the demand would fit into
+ *  the second-largest array, the largest one is drained and freed.
+ *
  *  MSG_ARRAY_SIZE is defined to be large (16 doublings) to allow for
  *  the edge case where messages are stuck for long periods of time.
  *
@@ -106,6 +114,19 @@ struct fr_message_set_t {
 	int			allocated;
 	int			freed;
 
+	int			gc_runs;	//!< number of times fr_message_gc() ran
+
+	int			mr_demand;	//!< decaying peak of messages in use after GC
+	int			mr_hwm;		//!< most messages ever in use after GC
+	int			mr_grown;	//!< number of message arrays added
+	int			mr_shrunk;	//!< number of message arrays freed for lack of demand
+
+	size_t			rb_demand;	//!< decaying peak of ring buffer data in use after GC
+	size_t			rb_hwm;		//!< most ring buffer data ever in use after GC
+	int			rb_grown;	//!< number of ring buffers added
+	int			rb_shrunk;	//!< number of ring buffers freed for lack of demand
+	bool			rb_draining;	//!< stop allocating from the largest ring buffer
+
 	fr_ring_buffer_t	*mr_array[MSG_ARRAY_SIZE]; //!< array of message arrays
 
 	fr_ring_buffer_t	*rb_array[MSG_ARRAY_SIZE]; //!< array of ring buffers
@@ -352,6 +373,177 @@ static int fr_message_ring_gc(fr_message_set_t *ms, fr_ring_buffer_t *mr, int ma
 }
 
 
+/** Add a message array to the message set
+ *
+ *  The new array is double the size of the previous largest one, or
+ *  twice the current demand, whichever is larger.  It becomes the
+ *  current array for new allocations.
+ *
+ * @param[in] ms the message set
+ * @return
+ *	- NULL on error
+ *	- the new message array on success
+ */
+static fr_ring_buffer_t *fr_message_mr_grow(fr_message_set_t *ms)
+{
+	fr_ring_buffer_t *mr;
+	size_t size, demand;
+
+	if ((ms->mr_max + 1) >= MSG_ARRAY_SIZE) {
+		fr_strerror_printf("All message arrays are full.");
+		return NULL;
+	}
+
+	size = fr_ring_buffer_size(ms->mr_array[ms->mr_max]) * 2;
+	demand = (size_t) ms->mr_demand * ms->message_size * 2;
+	if (size < demand) size = demand;
+
+	mr = fr_ring_buffer_create(ms, size);
+	if (!mr) {
+		fr_strerror_printf("Failed allocating ring buffer: %s", fr_strerror());
+		return NULL;
+	}
+
+	ms->mr_max++;
+	ms->mr_current = ms->mr_max;
+	ms->mr_array[ms->mr_max] = mr;
+	ms->mr_grown++;
+
+	MPRINT("SET MR to grown %d\n", ms->mr_current);
+
+	return mr;
+}
+
+/** Add a ring buffer to the message set
+ *
+ *  As with fr_message_mr_grow(), the new ring buffer is sized for
+ *  the current demand, and becomes the current one.
+ *
+ * @param[in] ms the message set
+ * @return
+ *	- NULL on error
+ *	- the new ring buffer on success
+ */
+static fr_ring_buffer_t *fr_message_rb_grow(fr_message_set_t *ms)
+{
+	fr_ring_buffer_t *rb;
+	size_t size;
+
+	if ((ms->rb_max + 1) >= MSG_ARRAY_SIZE) {
+		fr_strerror_printf("Message arrays are full");
+		return NULL;
+	}
+
+	size = fr_ring_buffer_size(ms->rb_array[ms->rb_max]) * 2;
+	if (size < (ms->rb_demand * 2)) size = ms->rb_demand * 2;
+
+	rb = fr_ring_buffer_create(ms, size);
+	if (!rb) {
+		fr_strerror_printf("Failed allocating ring buffer: %s", fr_strerror());
+		return NULL;
+	}
+
+	ms->rb_max++;
+	ms->rb_current = ms->rb_max;
+	ms->rb_array[ms->rb_max] = rb;
+	ms->rb_grown++;
+	ms->rb_draining = false;
+
+	MPRINT("RING BUFFER GROWS\n");
+
+	return rb;
+}
+
+/** Grow or shrink the message set to match demand
+ *
+ *  Called at the end of fr_message_gc().  Whatever is still in use
+ *  at that point hasn't been marked "done", so it's a reasonable
+ *  measure of what is in flight.
+ *
+ *  If that fills more than 3/4 of the set, we add another array now,
+ *  so that the next allocations don't fail, GC, and brute-force search
+ *  the arrays before doing the same thing.  If the demand fits into a
+ *  quarter of the second-largest array, we stop allocating from the
+ *  largest one, and free it once it is empty.
+ *
+ * @param[in] ms the message set
+ * @param[in] accurate whether the GC cleaned everything it could.
+ *	If it stopped early, the usage figures are too high.
+ */
+static void fr_message_set_adapt(fr_message_set_t *ms, bool accurate)
+{
+	int i, used;
+	size_t rb_used, rb_total, total;
+
+	if (!accurate) return;
+
+	used = 0;
+	total = 0;
+	for (i = 0; i <= ms->mr_max; i++) {
+		used += fr_ring_buffer_used(ms->mr_array[i]) / ms->message_size;
+		total += fr_ring_buffer_size(ms->mr_array[i]) / ms->message_size;
+	}
+
+	rb_used = 0;
+	rb_total = 0;
+	for (i = 0; i <= ms->rb_max; i++) {
+		rb_used += fr_ring_buffer_used(ms->rb_array[i]);
+		rb_total += fr_ring_buffer_size(ms->rb_array[i]);
+	}
+
+	if (used > ms->mr_hwm) ms->mr_hwm = used;
+	if (rb_used > ms->rb_hwm) ms->rb_hwm = rb_used;
+
+	/*
+	 *	Decay the old peak by 1/8 on every GC, so that a burst
+	 *	is remembered for a while, but not forever.
+	 */
+	ms->mr_demand -= ms->mr_demand >> 3;
+	if (used > ms->mr_demand) ms->mr_demand = used;
+
+	ms->rb_demand -= ms->rb_demand >> 3;
+	if (rb_used > ms->rb_demand) ms->rb_demand = rb_used;
+
+	MPRINT("ADAPT messages %d / %zd (demand %d), ring buffers %zd / %zd (demand %zd)\n",
+	       used, total, ms->mr_demand, rb_used, rb_total, ms->rb_demand);
+
+	if (((size_t) used * 4) > (total * 3)) {
+		(void) fr_message_mr_grow(ms);
+
+	} else if ((ms->mr_max > 0) &&
+		   (((size_t) ms->mr_demand * ms->message_size * 4) <= fr_ring_buffer_size(ms->mr_array[ms->mr_max - 1]))) {
+		if (fr_ring_buffer_used(ms->mr_array[ms->mr_max]) == 0) {
+			MPRINT("\tshrinking message arrays to %d\n", ms->mr_max);
+			TALLOC_FREE(ms->mr_array[ms->mr_max]);
+			ms->mr_max--;
+			ms->mr_shrunk++;
+			if (ms->mr_current > ms->mr_max) ms->mr_current = ms->mr_max;
+
+		} else if (ms->mr_current == ms->mr_max) {
+			ms->mr_current = ms->mr_max - 1;
+		}
+	}
+
+	ms->rb_draining = false;
+	if ((rb_used * 4) > (rb_total * 3)) {
+		(void) fr_message_rb_grow(ms);
+
+	} else if ((ms->rb_max > 0) &&
+		   ((ms->rb_demand * 4) <= fr_ring_buffer_size(ms->rb_array[ms->rb_max - 1]))) {
+		if (fr_ring_buffer_used(ms->rb_array[ms->rb_max]) == 0) {
+			MPRINT("\tshrinking ring buffers to %d\n", ms->rb_max);
+			TALLOC_FREE(ms->rb_array[ms->rb_max]);
+			ms->rb_max--;
+			ms->rb_shrunk++;
+			if (ms->rb_current > ms->rb_max) ms->rb_current = ms->rb_max;
+
+		} else {
+			ms->rb_draining = true;
+		}
+	}
+}
+
+
 /** Garbage collect "done" messages.
  *
  *  Called only from the originating thread.  We also clean a limited
@@ -363,12 +555,14 @@ static int fr_message_ring_gc(fr_message_set_t *ms, fr_ring_buffer_t *mr, int ma
  */
 static void fr_message_gc(fr_message_set_t *ms, int max_to_clean)
 {
-	int i;
+	int i, last;
 	int arrays_freed, arrays_used, empty_slot;
 	int largest_free_slot;
 	int total_cleaned;
 	size_t largest_free_size;
 
+	ms->gc_runs++;
+
 	/*
 	 *	Clean up "done" messages.
 	 */
@@ -391,9 +585,13 @@ static void fr_message_gc(fr_message_set_t *ms, int max_to_clean)
 	}
 
 	/*
-	 *	Couldn't GC anything.  Don't do more work.
+	 *	Couldn't GC anything.  Don't do more work, other than
+	 *	growing the set if everything in it is in use.
 	 */
-	if (total_cleaned == 0) return;
+	if (total_cleaned == 0) {
+		fr_message_set_adapt(ms, true);
+		return;
+	}
 
 	arrays_freed = 0;
 	arrays_used = 0;
@@ -590,20 +788,26 @@ static void fr_message_gc(fr_message_set_t *ms, int max_to_clean)
 #endif
 	}
 
+	fr_message_set_adapt(ms, (total_cleaned < max_to_clean));
+
 	/*
 	 *	Set the current ring buffer to the one with the
-	 *	largest free space in it.
+	 *	largest free space in it.  If the largest ring buffer
+	 *	is draining, it isn't a candidate.
 	 *
 	 *	This is different from the allocation strategy for
 	 *	messages.
 	 */
 	if (!rad_cond_assert(ms->rb_array[ms->rb_max] != NULL)) return;
 
-	largest_free_slot = ms->rb_max;
-	largest_free_size = (fr_ring_buffer_size(ms->rb_array[ms->rb_max]) -
-			     fr_ring_buffer_used(ms->rb_array[ms->rb_max]));
+	last = ms->rb_max;
+	if (ms->rb_draining) last--;
+
+	largest_free_slot = last;
+	largest_free_size = (fr_ring_buffer_size(ms->rb_array[last]) -
+			     fr_ring_buffer_used(ms->rb_array[last]));
 
-	for (i = 0; i < ms->rb_max; i++) {
+	for (i = 0; i < last; i++) {
 		size_t free_size;
 
 		rad_assert(ms->rb_array[i] != NULL);
@@ -637,35 +841,39 @@ static fr_message_t *fr_message_ring_alloc(fr_message_set_t *ms, fr_ring_buffer_
 	fr_message_t *m;
 
 	/*
-	 *	We're at the start of a buffer with data, and there's
-	 *	no room.  Do a quick check to see if we can free up
-	 *	the oldest entry.  If not, return.
-	 *
-	 *	Otherwise, fall through to allocating a entry, of
-	 *	which there must now be at least one free one.
-	 *
-	 *	This check results in a small amount of cache line
-	 *	thrashing.  But if the buffer is full, it's likely
-	 *	that the oldest entry can be freed.  If not, we have a
-	 *	small amount of cache thrashing, which should be
-	 *	extremely rare.
+	 *	Grab a new message from the underlying ring buffer.
+	 *	The array may have room, e.g. if it was just added,
+	 *	or if it's the array we're shrinking down to.
 	 */
-	if (clean) {
-		if (fr_message_ring_gc(ms, mr, 4) == 0) {
+	m = (fr_message_t *) fr_ring_buffer_alloc(mr, ms->message_size);
+	if (!m) {
+		/*
+		 *	We're at the start of a buffer with data, and
+		 *	there's no room.  Do a quick check to see if we
+		 *	can free up the oldest entry.  If not, return.
+		 *
+		 *	This check results in a small amount of cache
+		 *	line thrashing.  But if the buffer is full, it's
+		 *	likely that the oldest entry can be freed.  If
+		 *	not, we have a small amount of cache thrashing,
+		 *	which should be extremely rare.
+		 */
+		if (!clean || (fr_message_ring_gc(ms, mr, 4) == 0)) {
 			fr_strerror_printf("No free memory after GC attempt");
 			return NULL;
 		}
 
 		/*
 		 *	Else we cleaned up some entries in this array.
-		 *	Go allocate a message.
+		 *	There must now be at least one free one.
 		 */
+		m = (fr_message_t *) fr_ring_buffer_alloc(mr, ms->message_size);
+		if (!m) {
+			fr_strerror_printf("No free memory after GC attempt");
+			return NULL;
+		}
 	}
 
-	/*
-	 *	Grab a new message from the underlying ring buffer.
-	 */
-	m = (fr_message_t *) fr_ring_buffer_alloc(mr, ms->message_size);
 #ifndef NDEBUG
 	memset(m, 0, ms->message_size);
 #endif
@@ -750,34 +958,13 @@ static fr_message_t *fr_message_get_message(fr_message_set_t *ms, bool *p_cleane
 	}
 
 	/*
-	 *	All of the arrays are full.  If we don't have
-	 *	room to allocate another array, we're dead.
-	 */
-	if ((ms->mr_max + 1) >= MSG_ARRAY_SIZE) {
-		fr_strerror_printf("All message arrays are full.");
-		return NULL;
-	}
-
-	/*
-	 *	Allocate another message ring, double the size
-	 *	of the previous maximum.
+	 *	All of the arrays are full.  Allocate another
+	 *	message ring, and set it as current for all new
+	 *	allocations.  If we don't have room to allocate
+	 *	another array, we're dead.
 	 */
-	mr = fr_ring_buffer_create(ms, fr_ring_buffer_size(ms->mr_array[ms->mr_max]) * 2);
-	if (!mr) {
-		fr_strerror_printf("Failed allocating ring buffer: %s", fr_strerror());
-		return NULL;
-	}
-
-	/*
-	 *	Set the new one as current for all new
-	 *	allocations, allocate a message, and go try to
-	 *	reserve room for the raw packet data.
-	 */
-	ms->mr_max++;
-	ms->mr_current = ms->mr_max;
-	ms->mr_array[ms->mr_max] = mr;
-
-	MPRINT("SET MR to doubled %d\n", ms->mr_current);
+	mr = fr_message_mr_grow(ms);
+	if (!mr) return NULL;
 
 	/*
 	 *	And we should now have an entirely empty message ring.
@@ -871,36 +1058,15 @@ static fr_message_t *fr_message_get_ring_buffer(fr_message_set_t *ms, fr_message
 		}
 	}
 
-	/*
-	 *	All of the arrays are full.  If we don't have
-	 *	room to allocate another array, we're dead.
-	 */
-	if ((ms->rb_max + 1) >= MSG_ARRAY_SIZE) {
-		fr_strerror_printf("Message arrays are full");
-		goto cleanup;
-	}
-
 alloc_rb:
 	/*
-	 *	Allocate another message ring, double the size
-	 *	of the previous maximum.
+	 *	All of the arrays are full.  Allocate another ring
+	 *	buffer, and set it as current for all new
+	 *	allocations.  If we don't have room to allocate
+	 *	another array, we're dead.
 	 */
-	rb = fr_ring_buffer_create(ms, fr_ring_buffer_size(ms->rb_array[ms->rb_max]) * 2);
-	if (!rb) {
-		fr_strerror_printf("Failed allocating ring buffer: %s", fr_strerror());
-		goto cleanup;
-	}
-
-	MPRINT("RING BUFFER DOUBLES\n");
-
-	/*
-	 *	Set the new one as current for all new
-	 *	allocations, allocate a message, and go try to
-	 *	reserve room for the raw packet data.
-	 */
-	ms->rb_max++;
-	ms->rb_current = ms->rb_max;
-	ms->rb_array[ms->rb_current] = rb;
+	rb = fr_message_rb_grow(ms);
+	if (!rb) goto cleanup;
 
 	/*
 	 *	And we should now have an entirely empty message ring.
@@ -1309,6 +1475,42 @@ void fr_message_set_gc(fr_message_set_t *ms)
 	fr_message_gc(ms, 1 << 24);
 }
 
+/** Get usage figures for the message set.
+ *
+ * @param[in] ms the message set
+ * @param[out] stats where the figures are written.
+ */
+void fr_message_set_stats(fr_message_set_t *ms, fr_message_set_stats_t *stats)
+{
+	int i;
+
+	(void) talloc_get_type_abort(ms, fr_message_set_t);
+
+	memset(stats, 0, sizeof(*stats));
+
+	stats->allocated = ms->allocated;
+	stats->freed = ms->freed;
+	stats->gc_runs = ms->gc_runs;
+
+	stats->message_arrays = ms->mr_max + 1;
+	for (i = 0; i <= ms->mr_max; i++) {
+		stats->message_capacity += fr_ring_buffer_size(ms->mr_array[i]) / ms->message_size;
+	}
+	stats->messages_demand = ms->mr_demand;
+	stats->messages_hwm = ms->mr_hwm;
+	stats->message_arrays_grown = ms->mr_grown;
+	stats->message_arrays_shrunk = ms->mr_shrunk;
+
+	stats->ring_buffers = ms->rb_max + 1;
+	for (i = 0; i <= ms->rb_max; i++) {
+		stats->rb_capacity += fr_ring_buffer_size(ms->rb_array[i]);
+	}
+	stats->rb_demand = ms->rb_demand;
+	stats->rb_hwm = ms->rb_hwm;
+	stats->ring_buffers_grown = ms->rb_grown;
+	stats->ring_buffers_shrunk = ms->rb_shrunk;
+}
+
 /** Print debug information about the message set.
  *
  * @param[in] ms the message set
@@ -1322,6 +1524,11 @@ void fr_message_set_debug(fr_message_set_t *ms, FILE *fp)
 
 	fprintf(fp, "message arrays = %d\t(current %d)\n", ms->mr_max + 1, ms->mr_current);
 	fprintf(fp, "ring buffers   = %d\t(current %d)\n", ms->rb_max + 1, ms->rb_current);
+	fprintf(fp, "allocated      = %d\tfreed %d\tgc runs %d\n", ms->allocated, ms->freed, ms->gc_runs);
+	fprintf(fp, "messages       =\tdemand %d, high water %d, grown %d, shrunk %d\n",
+		ms->mr_demand, ms->mr_hwm, ms->mr_grown, ms->mr_shrunk);
+	fprintf(fp, "ring buffer    =\tdemand %zd, high water %zd, grown %d, shrunk %d%s\n",
+		ms->rb_demand, ms->rb_hwm, ms->rb_grown, ms->rb_shrunk, ms->rb_draining ? " (draining)" : "");
 
 	for (i = 0; i <= ms->mr_max; i++) {
 		fr_ring_buffer_t *mr = ms->mr_array[i];
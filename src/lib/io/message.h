@@ -51,6 +51,31 @@ typedef struct fr_message_t {
 	size_t			rb_size;	//!< cache-aligned size in the ring buffer
 } fr_message_t;
 
+/** Usage figures for a message set
+ *
+ *  The "in use" figures are sampled after each garbage collection, so
+ *  they approximate the number of messages in flight.
+ */
+typedef struct fr_message_set_stats_t {
+	int			allocated;	//!< messages allocated
+	int			freed;		//!< messages freed
+	int			gc_runs;	//!< number of garbage collections
+
+	int			message_arrays;	//!< number of message arrays
+	size_t			message_capacity; //!< total number of messages the arrays can hold
+	int			messages_demand; //!< decaying peak of messages in use
+	int			messages_hwm;	//!< most messages in use
+	int			message_arrays_grown; //!< message arrays added
+	int			message_arrays_shrunk; //!< message arrays freed for lack of demand
+
+	int			ring_buffers;	//!< number of ring buffers
+	size_t			rb_capacity;	//!< total size of the ring buffers
+	size_t			rb_demand;	//!< decaying peak of ring buffer data in use
+	size_t			rb_hwm;		//!< most ring buffer data in use
+	int			ring_buffers_grown; //!< ring buffers added
+	int			ring_buffers_shrunk; //!< ring buffers freed for lack of demand
+} fr_message_set_stats_t;
+
 fr_message_set_t *fr_message_set_create(TALLOC_CTX *ctx, int num_messages, size_t message_size, size_t ring_buffer_size) CC_HINT(nonnull);
 
 fr_message_t *fr_message_reserve(fr_message_set_t *ms, size_t reserve_size) CC_HINT(nonnull);
@@ -65,6 +90,7 @@ fr_message_t *fr_message_localize(TALLOC_CTX *ctx, fr_message_t *m, size_t messa
 int fr_message_set_messages_used(fr_message_set_t *ms) CC_HINT(nonnull);
 void fr_message_set_gc(fr_message_set_t *ms) CC_HINT(nonnull);
 
+void fr_message_set_stats(fr_message_set_t *ms, fr_message_set_stats_t *stats) CC_HINT(nonnull);
 void fr_message_set_debug(fr_message_set_t *ms, FILE *fp) CC_HINT(nonnull);
 
 #ifdef __cplusplus
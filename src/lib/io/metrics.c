@@ -0,0 +1,537 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Counters and histograms which are printed in OpenMetrics format.
+ * @file io/metrics.c
+ *
+ * Each thread updates its own sets of metrics, without locks.  All of
+ * the sets are on one list, which is only locked when a set is added
+ * or removed, and when the metrics are printed.  Printing adds up the
+ * sets which have the same labels, so a module has one set of counters,
+ * no matter how many workers there are.
+ *
+ * When a set is freed, its counters are added to a "retired" set with
+ * the same labels, so that they don't go backwards when a worker exits,
+ * or a connection closes.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <string.h>
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/io/metrics.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#define PTHREAD_MUTEX_LOCK   pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+
+static pthread_mutex_t	metric_mutex = PTHREAD_MUTEX_INITIALIZER;
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+static fr_dlist_t	metric_sets = { &metric_sets, &metric_sets };
+
+typedef _Atomic(fr_metric_set_t *) fr_metric_set_ptr_t;
+
+/*
+ *	The upper bounds of the histogram buckets we print, in
+ *	seconds.  The histograms have much finer buckets than this,
+ *	but nobody wants to scrape hundreds of them.
+ */
+static char const *metric_bounds[] = {
+	"0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01",
+	"0.025", "0.05", "0.1", "0.25", "0.5", "1", "2.5", "5", "10"
+};
+
+/** One line (or histogram) of output, added up from all of the sets
+ *
+ */
+typedef struct {
+	fr_metric_t const	*def;			//!< of the metric.
+	int			order;			//!< in which it was found.
+	char const		*key;			//!< name and labels, to find the series.
+	char const		*labels;		//!< all of the labels.
+	uint64_t		value;			//!< for counters and gauges.
+	fr_time_histogram_t	*histogram;		//!< for histograms.
+} fr_metric_series_t;
+
+static uint32_t metric_series_hash(void const *data)
+{
+	fr_metric_series_t const *series = data;
+
+	return fr_hash_string(series->key);
+}
+
+static int metric_series_cmp(void const *one, void const *two)
+{
+	fr_metric_series_t const *a = one;
+	fr_metric_series_t const *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+typedef struct {
+	fr_metric_series_t	**all;			//!< to fill in.
+	int			num;			//!< entries filled in so far.
+} fr_metric_series_list_t;
+
+static int _metric_series_list(void *ctx, void *data)
+{
+	fr_metric_series_list_t *list = ctx;
+
+	list->all[list->num++] = data;
+	return 0;
+}
+
+/** Sort series by family, and then in the order they were found
+ *
+ */
+static int metric_series_sort(void const *one, void const *two)
+{
+	fr_metric_series_t const *a = *(fr_metric_series_t const * const *) one;
+	fr_metric_series_t const *b = *(fr_metric_series_t const * const *) two;
+	int rcode;
+
+	rcode = strcmp(a->def->name, b->def->name);
+	if (rcode != 0) return rcode;
+
+	return (a->order > b->order) - (a->order < b->order);
+}
+
+/** Allocate the counters and histograms for a set
+ *
+ */
+static fr_metric_set_t *metric_set_create(TALLOC_CTX *ctx, fr_metric_t const *def, int num, bool shared)
+{
+	fr_metric_set_t	*ms;
+	int		i;
+
+	ms = talloc_zero(ctx, fr_metric_set_t);
+	if (!ms) return NULL;
+
+	ms->def = def;
+	ms->num = num;
+	ms->shared = shared;
+	FR_DLIST_INIT(ms->entry);
+
+	ms->value = talloc_zero_array(ms, atomic_ullong, num);
+	ms->histogram = talloc_zero_array(ms, fr_time_histogram_t *, num);
+	if (!ms->value || !ms->histogram) {
+	oom:
+		talloc_free(ms);
+		return NULL;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (def[i].type != FR_METRIC_HISTOGRAM) continue;
+
+		rad_assert(!shared);
+
+		ms->histogram[i] = talloc_zero(ms, fr_time_histogram_t);
+		if (!ms->histogram[i]) goto oom;
+	}
+
+	return ms;
+}
+
+/** Move the counters of a set which is being freed into the retired set
+ *
+ */
+static int _metric_set_free(fr_metric_set_t *ms)
+{
+	fr_dlist_t	*entry;
+	fr_metric_set_t	*old = NULL;
+	int		i;
+
+	PTHREAD_MUTEX_LOCK(&metric_mutex);
+	fr_dlist_remove(&ms->entry);
+
+	for (entry = FR_DLIST_FIRST(metric_sets);
+	     entry != NULL;
+	     entry = FR_DLIST_NEXT(metric_sets, entry)) {
+		fr_metric_set_t *r = fr_ptr_to_type(fr_metric_set_t, entry, entry);
+
+		if (!r->retired || (r->def != ms->def)) continue;
+		if (strcmp(r->labels, ms->labels) != 0) continue;
+
+		old = r;
+		break;
+	}
+
+	if (!old) {
+		old = metric_set_create(NULL, ms->def, ms->num, false);
+		if (!old) goto done;	/* the counters are lost */
+
+		old->retired = true;
+		old->labels = talloc_strdup(old, ms->labels);
+		if (!old->labels) {
+			talloc_free(old);
+			goto done;
+		}
+		fr_dlist_insert_tail(&metric_sets, &old->entry);
+	}
+
+	for (i = 0; i < ms->num; i++) {
+		switch (ms->def[i].type) {
+		case FR_METRIC_COUNTER:
+			fr_metric_add(old, i, atomic_load_explicit(&ms->value[i], memory_order_relaxed));
+			break;
+
+		case FR_METRIC_HISTOGRAM:
+			fr_time_histogram_merge(old->histogram[i], ms->histogram[i]);
+			break;
+
+		case FR_METRIC_GAUGE:
+			break;
+		}
+	}
+
+done:
+	PTHREAD_MUTEX_UNLOCK(&metric_mutex);
+	return 0;
+}
+
+/** Allocate a set of metrics
+ *
+ *  The set has no labels until fr_metric_set_label() is called.
+ *  The set is printed until it is freed.
+ *
+ * @param[in] ctx	to allocate the set in.
+ * @param[in] def	the metrics in the set.  Must be static.
+ * @param[in] num	number of metrics in "def".
+ * @param[in] shared	whether more than one thread writes to the set.
+ * @return
+ *	- NULL on error.
+ *	- the new set.
+ */
+fr_metric_set_t *fr_metric_set_alloc(TALLOC_CTX *ctx, fr_metric_t const *def, int num, bool shared)
+{
+	fr_metric_set_t *ms;
+
+	ms = metric_set_create(ctx, def, num, shared);
+	if (!ms) {
+	oom:
+		fr_strerror_printf("Failed allocating memory");
+		return NULL;
+	}
+
+	ms->labels = talloc_strdup(ms, "");
+	if (!ms->labels) {
+		talloc_free(ms);
+		goto oom;
+	}
+
+	PTHREAD_MUTEX_LOCK(&metric_mutex);
+	fr_dlist_insert_tail(&metric_sets, &ms->entry);
+	PTHREAD_MUTEX_UNLOCK(&metric_mutex);
+
+	talloc_set_destructor(ms, _metric_set_free);
+
+	return ms;
+}
+
+/** Add a label to a set
+ *
+ * @param[in] ms	the set.
+ * @param[in] name	of the label.
+ * @param[in] value	of the label.  It's escaped as OpenMetrics requires.
+ * @return
+ *	- <0 on error.
+ *	- 0 on success.
+ */
+int fr_metric_set_label(fr_metric_set_t *ms, char const *name, char const *value)
+{
+	char		*labels, *q;
+	char const	*p;
+	size_t		len;
+
+	len = strlen(ms->labels) + strlen(name) + (2 * strlen(value)) + 5;
+	labels = talloc_array(ms, char, len);
+	if (!labels) {
+		fr_strerror_printf("Failed allocating memory");
+		return -1;
+	}
+
+	q = labels + snprintf(labels, len, "%s%s%s=\"", ms->labels, *ms->labels ? "," : "", name);
+	for (p = value; *p; p++) {
+		switch (*p) {
+		case '\\':
+		case '"':
+			*q++ = '\\';
+			*q++ = *p;
+			break;
+
+		case '\n':
+			*q++ = '\\';
+			*q++ = 'n';
+			break;
+
+		default:
+			*q++ = *p;
+			break;
+		}
+	}
+	*q++ = '"';
+	*q = '\0';
+
+	PTHREAD_MUTEX_LOCK(&metric_mutex);
+	talloc_free(ms->labels);
+	ms->labels = labels;
+	PTHREAD_MUTEX_UNLOCK(&metric_mutex);
+
+	return 0;
+}
+
+/** Allocate a shared set the first time it's needed
+ *
+ *  This is for things like clients, which are used by many threads,
+ *  and which don't know about metrics when they're created.  After
+ *  the first call, it's one load.
+ *
+ * @param[in,out] ms_p	where the set is kept.
+ * @param[in] ctx	to allocate the set in.
+ * @param[in] def	the metrics in the set.
+ * @param[in] num	number of metrics in "def".
+ * @param[in] name	of the label which identifies the set.
+ * @param[in] value	of the label.
+ * @return
+ *	- NULL on error.
+ *	- the set.
+ */
+fr_metric_set_t *fr_metric_set_once(fr_metric_set_t **ms_p, TALLOC_CTX *ctx, fr_metric_t const *def, int num,
+				    char const *name, char const *value)
+{
+	fr_metric_set_ptr_t	*p = (fr_metric_set_ptr_t *) ms_p;
+	fr_metric_set_t		*ms;
+#ifdef HAVE_PTHREAD_H
+	static pthread_mutex_t	once_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+	ms = atomic_load_explicit(p, memory_order_acquire);
+	if (ms) return ms;
+
+	PTHREAD_MUTEX_LOCK(&once_mutex);
+	ms = atomic_load_explicit(p, memory_order_relaxed);
+	if (!ms) {
+		ms = fr_metric_set_alloc(ctx, def, num, true);
+		if (ms && (fr_metric_set_label(ms, name, value) < 0)) TALLOC_FREE(ms);
+		if (ms) atomic_store_explicit(p, ms, memory_order_release);
+	}
+	PTHREAD_MUTEX_UNLOCK(&once_mutex);
+
+	return ms;
+}
+
+/** Print a histogram
+ *
+ * @param[in] out	buffer to append to.
+ * @param[in] name	of the metric family.
+ * @param[in] labels	to identify the histogram, or "".
+ * @param[in] h		the histogram.
+ * @return the buffer.
+ */
+char *fr_metric_histogram_print(char *out, char const *name, char const *labels, fr_time_histogram_t *h)
+{
+	size_t		i;
+	uint64_t	count;
+	char const	*comma = *labels ? "," : "";
+
+	for (i = 0; i < (sizeof(metric_bounds) / sizeof(*metric_bounds)); i++) {
+		out = talloc_asprintf_append_buffer(out, "%s_bucket{%s%sle=\"%s\"} %" PRIu64 "\n",
+						    name, labels, comma, metric_bounds[i],
+						    fr_time_histogram_count_le(h, (fr_time_t) (atof(metric_bounds[i]) * NANOSEC)));
+	}
+
+	/*
+	 *	The count has to match the +Inf bucket, so we don't
+	 *	use h->count, which may lag behind the buckets.
+	 */
+	count = fr_time_histogram_count_le(h, (fr_time_t) ~0);
+	out = talloc_asprintf_append_buffer(out, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, comma, count);
+	out = talloc_asprintf_append_buffer(out, "%s_sum%s%s%s %.9f\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+					    ((double) atomic_load_explicit(&h->total, memory_order_relaxed)) / NANOSEC);
+	out = talloc_asprintf_append_buffer(out, "%s_count%s%s%s %" PRIu64 "\n", name,
+					    *labels ? "{" : "", labels, *labels ? "}" : "", count);
+
+	return out;
+}
+
+/** Print all of the metrics
+ *
+ *  Sets with the same labels are added together.  The families are
+ *  printed in alphabetical order.  "# EOF" isn't printed, so that the
+ *  caller can add its own metrics.
+ *
+ * @param[in] out	buffer to append to.
+ * @return the buffer.
+ */
+char *fr_metric_print(char *out)
+{
+	TALLOC_CTX		*ctx;
+	fr_hash_table_t		*ht;
+	fr_metric_series_t	*series, my_series;
+	fr_metric_series_list_t	list;
+	fr_metric_t const	*family = NULL;
+	fr_dlist_t		*entry;
+	int			i, num = 0;
+
+	ctx = talloc_new(NULL);
+	if (!ctx) return out;
+
+	ht = fr_hash_table_create(ctx, metric_series_hash, metric_series_cmp, NULL);
+	if (!ht) goto done;
+
+	PTHREAD_MUTEX_LOCK(&metric_mutex);
+	for (entry = FR_DLIST_FIRST(metric_sets);
+	     entry != NULL;
+	     entry = FR_DLIST_NEXT(metric_sets, entry)) {
+		fr_metric_set_t *ms = fr_ptr_to_type(fr_metric_set_t, entry, entry);
+
+		for (i = 0; i < ms->num; i++) {
+			fr_metric_t const *def = &ms->def[i];
+			char *labels;
+
+			if (def->label) {
+				labels = talloc_asprintf(ctx, "%s%s%s", ms->labels, *ms->labels ? "," : "", def->label);
+			} else {
+				labels = talloc_strdup(ctx, ms->labels);
+			}
+			if (!labels) break;
+
+			my_series.key = talloc_asprintf(ctx, "%s{%s}", def->name, labels);
+			if (!my_series.key) break;
+
+			series = fr_hash_table_finddata(ht, &my_series);
+			if (!series) {
+				series = talloc_zero(ctx, fr_metric_series_t);
+				if (!series) break;
+
+				series->def = def;
+				series->order = num;
+				series->key = my_series.key;
+				series->labels = labels;
+				if (def->type == FR_METRIC_HISTOGRAM) {
+					series->histogram = talloc_zero(series, fr_time_histogram_t);
+					if (!series->histogram) break;
+				}
+
+				if (!fr_hash_table_insert(ht, series)) break;
+				num++;
+			}
+
+			if (def->type == FR_METRIC_HISTOGRAM) {
+				fr_time_histogram_merge(series->histogram, ms->histogram[i]);
+			} else {
+				series->value += atomic_load_explicit(&ms->value[i], memory_order_relaxed);
+			}
+		}
+	}
+	PTHREAD_MUTEX_UNLOCK(&metric_mutex);
+
+	if (!num) goto done;
+
+	list.all = talloc_array(ctx, fr_metric_series_t *, num);
+	if (!list.all) goto done;
+
+	list.num = 0;
+	(void) fr_hash_table_walk(ht, _metric_series_list, &list);
+	qsort(list.all, num, sizeof(*list.all), metric_series_sort);
+
+	for (i = 0; i < num; i++) {
+		fr_metric_t const *def = list.all[i]->def;
+		char const *labels = list.all[i]->labels;
+
+		if (!family || (strcmp(family->name, def->name) != 0)) {
+			family = def;
+			out = talloc_asprintf_append_buffer(out, "# TYPE %s %s\n# HELP %s %s\n", def->name,
+							    (def->type == FR_METRIC_COUNTER) ? "counter" :
+							    (def->type == FR_METRIC_GAUGE) ? "gauge" : "histogram",
+							    def->name, def->help);
+		}
+
+		switch (def->type) {
+		case FR_METRIC_COUNTER:
+			out = talloc_asprintf_append_buffer(out, "%s_total%s%s%s %" PRIu64 "\n", def->name,
+							    *labels ? "{" : "", labels, *labels ? "}" : "",
+							    list.all[i]->value);
+			break;
+
+		case FR_METRIC_GAUGE:
+			out = talloc_asprintf_append_buffer(out, "%s%s%s%s %" PRId64 "\n", def->name,
+							    *labels ? "{" : "", labels, *labels ? "}" : "",
+							    (int64_t) list.all[i]->value);
+			break;
+
+		case FR_METRIC_HISTOGRAM:
+			out = fr_metric_histogram_print(out, def->name, labels, list.all[i]->histogram);
+			break;
+		}
+	}
+
+done:
+	talloc_free(ctx);
+	return out;
+}
+
+/** Call a function with the value of a counter or gauge, in every set
+ *
+ *  Metrics with extra labels, e.g. one counter per packet type, are
+ *  all passed to the function.  The caller adds them up if it needs
+ *  to.  Retired sets are included, so counters don't go backwards
+ *  when a thread exits.
+ *
+ *  The function is called with a mutex held, so it must not
+ *  allocate or free sets.
+ *
+ * @param[in] name	of the metric family.
+ * @param[in] walk	function to call for each value.
+ * @param[in] uctx	passed to "walk".
+ * @return
+ *	- <0 if "walk" returned an error.
+ *	- 0 on success.
+ */
+int fr_metric_walk(char const *name, fr_metric_walk_t walk, void *uctx)
+{
+	fr_dlist_t	*entry;
+	int		i, rcode = 0;
+
+	PTHREAD_MUTEX_LOCK(&metric_mutex);
+	for (entry = FR_DLIST_FIRST(metric_sets);
+	     entry != NULL;
+	     entry = FR_DLIST_NEXT(metric_sets, entry)) {
+		fr_metric_set_t *ms = fr_ptr_to_type(fr_metric_set_t, entry, entry);
+
+		for (i = 0; i < ms->num; i++) {
+			if (ms->def[i].type == FR_METRIC_HISTOGRAM) continue;
+			if (strcmp(ms->def[i].name, name) != 0) continue;
+
+			rcode = walk(uctx, ms->labels, atomic_load_explicit(&ms->value[i], memory_order_relaxed));
+			if (rcode < 0) goto done;
+		}
+	}
+
+done:
+	PTHREAD_MUTEX_UNLOCK(&metric_mutex);
+	return rcode;
+}
@@ -0,0 +1,137 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_METRICS_H
+#define _FR_METRICS_H
+/**
+ * $Id$
+ *
+ * @file io/metrics.h
+ * @brief Counters and histograms which are printed in OpenMetrics format.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSIDH(metrics_h, "$Id$")
+
+#include <talloc.h>
+
+#include <freeradius-devel/io/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ *  The types of metric.
+ */
+typedef enum fr_metric_type_t {
+	FR_METRIC_COUNTER = 0,			//!< only goes up.  Kept when the set is freed.
+	FR_METRIC_GAUGE,			//!< goes up and down.  Dropped when the set is freed.
+	FR_METRIC_HISTOGRAM			//!< times, in a fr_time_histogram_t
+} fr_metric_type_t;
+
+/**
+ *  The definition of one metric in a set.
+ *
+ *  Metrics with the same name are one family, and are printed
+ *  together.  They must all have the same type and help text.
+ */
+typedef struct fr_metric_t {
+	char const		*name;		//!< of the family, without any "_total" suffix
+	char const		*label;		//!< extra label for this metric, e.g. rcode="ok", or NULL
+	fr_metric_type_t	type;		//!< of the metric
+	char const		*help;		//!< description of the family
+} fr_metric_t;
+
+/**
+ *  The metrics for one thing, e.g. a module in one worker thread.
+ *
+ *  A set normally has only one writer, which updates it without
+ *  locks, or locked instructions.  Sets which are "shared" are
+ *  updated with atomic instructions, and can't have histograms.
+ *
+ *  The sets are only looked at when the metrics are printed.  Sets
+ *  with the same labels are added together then, so each thread can
+ *  have its own set for the same thing.
+ */
+typedef struct fr_metric_set_t {
+	fr_dlist_t		entry;		//!< in the list of all sets
+	fr_metric_t const	*def;		//!< the metrics in the set
+	int			num;		//!< number of entries in "def"
+	bool			shared;		//!< the set has more than one writer
+	bool			retired;	//!< holds the counters from sets which were freed
+	char			*labels;	//!< which identify the set, e.g. module="sql"
+	atomic_ullong		*value;		//!< one per metric, unused for histograms
+	fr_time_histogram_t	**histogram;	//!< one per metric, NULL except for histograms
+} fr_metric_set_t;
+
+/** Called by fr_metric_walk() with the labels of a set, and the value of a metric in it
+ *
+ */
+typedef int (*fr_metric_walk_t)(void *uctx, char const *labels, uint64_t value);
+
+fr_metric_set_t	*fr_metric_set_alloc(TALLOC_CTX *ctx, fr_metric_t const *def, int num, bool shared) CC_HINT(nonnull(2));
+int		fr_metric_set_label(fr_metric_set_t *ms, char const *name, char const *value) CC_HINT(nonnull);
+fr_metric_set_t	*fr_metric_set_once(fr_metric_set_t **ms_p, TALLOC_CTX *ctx, fr_metric_t const *def, int num,
+				    char const *name, char const *value) CC_HINT(nonnull(1,3,5,6));
+char		*fr_metric_print(char *out) CC_HINT(nonnull);
+int		fr_metric_walk(char const *name, fr_metric_walk_t walk, void *uctx) CC_HINT(nonnull(1,2));
+char		*fr_metric_histogram_print(char *out, char const *name, char const *labels,
+					   fr_time_histogram_t *h) CC_HINT(nonnull);
+
+/** Add to a counter or gauge
+ *
+ */
+static inline void fr_metric_add(fr_metric_set_t *ms, int i, uint64_t n)
+{
+	if (ms->shared) {
+		atomic_fetch_add_explicit(&ms->value[i], n, memory_order_relaxed);
+		return;
+	}
+
+	atomic_store_explicit(&ms->value[i], atomic_load_explicit(&ms->value[i], memory_order_relaxed) + n,
+			      memory_order_relaxed);
+}
+
+/** Add one to a counter or gauge
+ *
+ */
+static inline void fr_metric_inc(fr_metric_set_t *ms, int i)
+{
+	fr_metric_add(ms, i, 1);
+}
+
+/** Subtract one from a gauge
+ *
+ */
+static inline void fr_metric_dec(fr_metric_set_t *ms, int i)
+{
+	fr_metric_add(ms, i, (uint64_t) -1);
+}
+
+/** Add a time to a histogram
+ *
+ *  Only the thread which owns the set may call this function.
+ */
+static inline void fr_metric_time(fr_metric_set_t *ms, int i, fr_time_t value)
+{
+	fr_time_histogram_add(ms->histogram[i], value);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FR_METRICS_H */
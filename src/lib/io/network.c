@@ -34,6 +34,11 @@ RCSID("$Id$")
 #include <freeradius-devel/io/worker.h>
 #include <freeradius-devel/io/network.h>
 #include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/memory.h>
+#include <freeradius-devel/io/metrics.h>
+#include <freeradius-devel/io/rate_limit.h>
+#include <freeradius-devel/io/trace.h>
+#include <freeradius-devel/probe.h>
 
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
@@ -45,6 +50,13 @@ RCSID("$Id$")
 #define PTHREAD_MUTEX_UNLOCK
 #endif
 
+/*
+ *	By default, stop sending normal priority packets to a worker
+ *	when it has this many requests outstanding.  Lower priority
+ *	packets are dropped before that.
+ */
+#define NETWORK_MAX_OUTSTANDING	(1024)
+
 typedef struct fr_network_worker_t {
 	int			heap_id;		//!< workers are in a heap
 	fr_time_t		cpu_time;		//!< how much CPU time this worker has spent
@@ -52,6 +64,14 @@ typedef struct fr_network_worker_t {
 
 	fr_channel_t		*channel;		//!< channel to the worker
 	fr_worker_t		*worker;		//!< worker pointer
+
+	bool			flush;			//!< we've sent requests since the last flush
+	fr_dlist_t		entry;			//!< in the list of channels to flush
+
+	fr_dlist_t		link;			//!< in the list of all workers
+	bool			closing;		//!< we've told the worker that the channel is closing
+	bool			closed;			//!< the worker has acknowledged the close
+	int			num_replies;		//!< replies from this worker which we haven't yet written
 } fr_network_worker_t;
 
 typedef struct fr_network_socket_t {
@@ -59,8 +79,47 @@ typedef struct fr_network_socket_t {
 
 	fr_message_set_t	*ms;			//!< message buffers for this socket.
 	fr_channel_data_t	*cd;			//!< cached in case of allocation & read error
+
+	int			outstanding;		//!< requests read from a connection which haven't
+							///< been replied to.
+	bool			blocked;		//!< we're waiting for the socket to become writable.
+	bool			dead;			//!< the connection has been closed, and we're waiting
+							///< for the replies to its outstanding requests.
+	fr_event_timer_t const	*read_ev;		//!< to read data the transport has buffered.
+
+	fr_metric_set_t		*metrics;		//!< counters for the listener.
 } fr_network_socket_t;
 
+/*
+ *	The metrics for each socket.  Connections are counted as part
+ *	of the listener they were accepted on.
+ */
+typedef enum {
+	NETWORK_METRIC_RECEIVED = 0,
+	NETWORK_METRIC_DROPPED,
+	NETWORK_METRIC_SENT,
+	NETWORK_METRIC_WRITE_ERRORS,
+	NETWORK_METRIC_CONNECTIONS,
+	NETWORK_METRIC_RATE_LIMITED,
+	NETWORK_METRIC_MAX
+} fr_network_metric_t;
+
+static fr_metric_t const network_metrics[NETWORK_METRIC_MAX] = {
+	[NETWORK_METRIC_RECEIVED] = { "freeradius_listener_packets_received", NULL, FR_METRIC_COUNTER,
+				      "Packets read from the listener." },
+	[NETWORK_METRIC_DROPPED] = { "freeradius_listener_packets_dropped", NULL, FR_METRIC_COUNTER,
+				     "Packets which were read, but not given to a worker." },
+	[NETWORK_METRIC_SENT] = { "freeradius_listener_packets_sent", NULL, FR_METRIC_COUNTER,
+				  "Replies written to the listener." },
+	[NETWORK_METRIC_WRITE_ERRORS] = { "freeradius_listener_write_errors", NULL, FR_METRIC_COUNTER,
+					  "Replies which couldn't be written." },
+	[NETWORK_METRIC_CONNECTIONS] = { "freeradius_listener_connections", NULL, FR_METRIC_GAUGE,
+					 "Open connections, for connected transports." },
+	[NETWORK_METRIC_RATE_LIMITED] = { "freeradius_listener_packets_rate_limited", NULL, FR_METRIC_COUNTER,
+					  "Packets over their client's rate limit.  They're dropped, or "
+					  "deferred, as the client says." },
+};
+
 /*
  *	@todo - have an array of workers, so we can index the workers in O(1) time.
  *	remove the heap of "workers ordered by CPU time"
@@ -91,18 +150,36 @@ struct fr_network_t {
 	fr_heap_t		*replies;		//!< replies from the worker, ordered by priority / origin time
 	fr_heap_t		*workers;		//!< workers, ordered by total CPU time spent
 	fr_heap_t		*closing;		//!< workers which are being closed
+	fr_dlist_t		worker_list;		//!< all workers, so that we can find one to close
 
 	uint64_t		num_requests;		//!< number of requests we sent
 	uint64_t		num_replies;		//!< number of replies we received
 
+	int			watermark[FR_IO_PRIORITY_MAX];	//!< drop packets of a priority when the
+								///< least loaded worker has this many
+								///< requests outstanding.
+	uint64_t		dropped[FR_NETWORK_DROP_MAX];	//!< packets dropped, by reason
+	uint64_t		dropped_priority[FR_IO_PRIORITY_MAX]; //!< packets dropped, by priority
+
 	rbtree_t		*sockets;		//!< list of sockets we're managing
 
+	fr_dlist_t		flush;			//!< workers we've sent requests to in this event loop pass
+
+	fr_memory_t		*memory;		//!< used by the message sets of the sockets.  May be NULL.
+	size_t			memory_used;		//!< what we last counted in "memory"
+
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_t		mutex;			//!< for sending us control messages
 #endif
 };
 
 static void fr_network_post_event(fr_event_list_t *el, struct timeval *now, void *uctx);
+static void fr_network_socket_dead(fr_network_t *nr, fr_network_socket_t *s);
+static void fr_network_write(fr_event_list_t *el, int sockfd, int flags, void *ctx);
+static void fr_network_accept(fr_event_list_t *el, int sockfd, int flags, void *ctx);
+static void fr_network_read_pending(fr_event_list_t *el, struct timeval *now, void *uctx);
+static int fr_network_flush(void *ctx, void *data);
+static void fr_network_error(fr_event_list_t *el, int sockfd, int flags, int fd_errno, void *ctx);
 
 static int worker_cmp(void const *one, void const *two)
 {
@@ -157,10 +234,13 @@ static void fr_network_drain_input(fr_network_t *nr, fr_channel_t *ch, fr_channe
 
 		cd->channel.ch = ch;
 
+		if (cd->trace) fr_trace_phase(cd->trace, "channel.reply", fr_time());
+
 		/*
 		 *	Update stats for the worker.
 		 */
 		w = fr_channel_master_ctx_get(ch);
+		w->num_replies++;
 		w->cpu_time = cd->reply.cpu_time;
 		if (!w->predicted) {
 			w->predicted = cd->reply.processing_time;
@@ -172,6 +252,78 @@ static void fr_network_drain_input(fr_network_t *nr, fr_channel_t *ch, fr_channe
 	} while ((cd = fr_channel_recv_reply(ch)) != NULL);
 }
 
+/** Stop sending requests to a worker
+ *
+ *  The worker is removed from the heap of workers, and the channel
+ *  is signalled that it's closing.  The worker will acknowledge the
+ *  close once it has replied to all of the requests we've sent it.
+ *
+ * @param[in] nr the network
+ * @param[in] w the worker to close
+ */
+static void fr_network_worker_close(fr_network_t *nr, fr_network_worker_t *w)
+{
+	if (w->closing) return;
+
+	/*
+	 *	Don't leave deferred signals behind.
+	 */
+	if (w->flush) {
+		fr_dlist_remove(&w->entry);
+		w->flush = false;
+
+		if (fr_channel_master_flush(w->channel) < 0) {
+			fr_log(nr->log, L_DBG_ERR, "Failed signaling worker: %s", fr_strerror());
+		}
+	}
+
+	(void) fr_heap_extract(nr->workers, w);
+
+	w->closing = true;
+	(void) fr_heap_insert(nr->closing, w);
+
+	fr_channel_signal_worker_close(w->channel);
+}
+
+/** The worker has acknowledged that a channel is closed
+ *
+ *  The worker's message set now belongs to the channel, so we only
+ *  free the channel after all of the replies in it have been
+ *  written.
+ *
+ * @param[in] nr the network
+ * @param[in] ch the channel which was closed
+ */
+static void fr_network_channel_closed(fr_network_t *nr, fr_channel_t *ch)
+{
+	fr_network_worker_t *w;
+
+	w = talloc_get_type_abort(fr_channel_master_ctx_get(ch), fr_network_worker_t);
+
+	/*
+	 *	The worker may have sent replies before the close.
+	 */
+	fr_network_drain_input(nr, ch, NULL);
+
+	/*
+	 *	The worker is exiting on its own, e.g. at shutdown.
+	 */
+	if (!w->closing) {
+		if (w->flush) {
+			fr_dlist_remove(&w->entry);
+			w->flush = false;
+		}
+		(void) fr_heap_extract(nr->workers, w);
+	} else {
+		(void) fr_heap_extract(nr->closing, w);
+	}
+
+	fr_dlist_remove(&w->link);
+	w->closed = true;
+
+	if (!w->num_replies) talloc_free(w);
+}
+
 /** Handle a network control message callback for a channel
  *
  * @param[in] ctx the network
@@ -216,8 +368,9 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
 		break;
 
 	case FR_CHANNEL_CLOSE:
+		rad_assert(ch != NULL);
 		fr_log(nr->log, L_DBG, "aq channel close");
-		///
+		fr_network_channel_closed(nr, ch);
 		break;
 	}
 }
@@ -226,22 +379,20 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
  *
  * @param nr the network
  * @param cd the message we've received
+ * @return
+ *	- 0 if every channel refused the message.
+ *	- 1 if the message was sent.
  */
-static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
+static int fr_network_send_worker(fr_network_t *nr, fr_channel_data_t *cd)
 {
 	fr_network_worker_t *worker;
 	fr_channel_data_t *reply;
 
-	(void) talloc_get_type_abort(nr, fr_network_t);
-
 	/*
 	 *	Grab the worker with the least total CPU time.
 	 */
 	worker = fr_heap_pop(nr->workers);
-	if (!worker) {
-		fr_log(nr->log, L_DBG, "no workers");
-		return 0;
-	}
+	if (!worker) return 0;
 
 	(void) talloc_get_type_abort(worker, fr_network_worker_t);
 
@@ -254,15 +405,12 @@ static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
 	 *	fail is because the recipient is not servicing it's
 	 *	queue.  When that happens, we just hand the request to
 	 *	another channel.
-	 *
-	 *	If we run out of channels to use, the caller needs to
-	 *	allocate another one, and hand it to the scheduler.
 	 */
 	if (fr_channel_send_request(worker->channel, cd, &reply) < 0) {
 		int rcode;
 
 		fr_log(nr->log, L_DBG, "recursing in send_request");
-		rcode = fr_network_send_request(nr, cd);
+		rcode = fr_network_send_worker(nr, cd);
 
 		/*
 		 *	Mark this channel as still busy, for some
@@ -276,6 +424,16 @@ static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
 		return rcode;
 	}
 
+	/*
+	 *	The channel may have deferred the signal to the
+	 *	worker.  We flush all of them once per event loop
+	 *	pass, in fr_network_post_event().
+	 */
+	if (!worker->flush) {
+		worker->flush = true;
+		fr_dlist_insert_tail(&nr->flush, &worker->entry);
+	}
+
 	/*
 	 *	We're projecting that the worker will use more CPU
 	 *	time to process this request.  The CPU time will be
@@ -298,32 +456,178 @@ static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
 	return 1;
 }
 
+/** Send a request to a worker, or drop it if the workers are overloaded
+ *
+ *  The least loaded worker is the one we would send the request to.
+ *  If it already has more requests outstanding than the watermark for
+ *  this packet's priority, the workers are falling behind, and we drop
+ *  the packet here.  Low priority packets are dropped first, so that
+ *  e.g. a slow database doesn't stop us from answering Status-Server.
+ *
+ *  Dropping the packet early is better than queueing it.  A queued
+ *  packet will likely time out in the worker, after the client has
+ *  already retransmitted it.
+ *
+ * @param nr the network
+ * @param cd the message we've received
+ * @return
+ *	- 0 the message was dropped, and the caller should free it.
+ *	- 1 the message was sent.
+ */
+static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
+{
+	fr_network_worker_t *worker;
+	fr_network_drop_t reason;
+
+	(void) talloc_get_type_abort(nr, fr_network_t);
+
+	rad_assert(cd->priority < FR_IO_PRIORITY_MAX);
+
+	worker = fr_heap_peek(nr->workers);
+	if (!worker) {
+		reason = FR_NETWORK_DROP_NO_WORKERS;
+		goto drop;
+	}
+
+	if (fr_channel_num_outstanding(worker->channel) >= nr->watermark[cd->priority]) {
+		reason = FR_NETWORK_DROP_OVERLOAD;
+		goto drop;
+	}
 
-/** Read a packet from the network.
+	if (!fr_network_send_worker(nr, cd)) {
+		reason = FR_NETWORK_DROP_CHANNEL_FULL;
+		goto drop;
+	}
+
+	nr->num_requests++;
+	return 1;
+
+drop:
+	nr->dropped[reason]++;
+	nr->dropped_priority[cd->priority]++;
+
+	fr_log(nr->log, L_DBG, "dropping packet with priority %u: %s", cd->priority,
+	       (reason == FR_NETWORK_DROP_NO_WORKERS) ? "no workers" :
+	       (reason == FR_NETWORK_DROP_OVERLOAD) ? "workers are overloaded" :
+	       "all worker channels are full");
+	return 0;
+}
+
+
+/** Send a copy of a sampled packet to the listener's mirror
  *
- * @param[in] el	the event list.
+ *  The copy runs in a shadow virtual server, at background priority,
+ *  so it only gets CPU time which production traffic doesn't need.
+ *  If the workers are busy, the copy is dropped.  Copies aren't
+ *  counted as requests or drops, so they don't skew the production
+ *  statistics.
+ *
+ * @param[in] nr	the network.
+ * @param[in] s		the network socket context.
+ * @param[in] cd	the packet, which has just been read.
+ */
+static void fr_network_mirror(fr_network_t *nr, fr_network_socket_t *s, fr_channel_data_t *cd)
+{
+	fr_listen_t const	*mirror = s->listen->mirror;
+	fr_network_worker_t	*worker;
+	fr_channel_data_t	*copy;
+
+	if ((s->listen->mirror_sample > 1) && ((fr_rand() % s->listen->mirror_sample) != 0)) return;
+
+	worker = fr_heap_peek(nr->workers);
+	if (!worker ||
+	    (fr_channel_num_outstanding(worker->channel) >= nr->watermark[FR_IO_PRIORITY_BACKGROUND])) return;
+
+	copy = (fr_channel_data_t *) fr_message_reserve(s->ms, cd->m.data_size);
+	if (!copy) return;
+
+	memcpy(copy->m.data, cd->m.data, cd->m.data_size);
+	(void) fr_message_alloc(s->ms, &copy->m, cd->m.data_size);
+
+	copy->packet_ctx = s->listen->app_io->mirror(nr, s->listen->app_io_instance, cd->packet_ctx);
+	if (!copy->packet_ctx) {
+		fr_message_done(&copy->m);
+		return;
+	}
+
+	copy->m.when = cd->m.when;
+	copy->priority = FR_IO_PRIORITY_BACKGROUND;
+	copy->listen = mirror;
+	copy->request.recv_time = NULL;
+	copy->request.deadline = 0;
+	if (mirror->deadline[copy->priority]) copy->request.deadline = copy->m.when + mirror->deadline[copy->priority];
+	copy->trace = NULL;
+
+	if (!fr_network_send_worker(nr, copy)) {
+		fr_log(nr->log, L_DBG, "dropping mirrored packet: all worker channels are full");
+		talloc_free(copy->packet_ctx);
+		fr_message_done(&copy->m);
+	}
+}
+
+/** Read one packet from the network.
+ *
+ * @param[in] nr	the network.
+ * @param[in] s		the network socket context.
  * @param[in] sockfd	the socket which is ready to read.
- * @param[in] flags	from kevent.
- * @param[in] ctx	the network socket context.
+ * @return
+ *	- <0 on error, and the socket has been closed.
+ *	- 0 on no more data to read.
+ *	- 1 on a packet was read.
  */
-static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED int flags, void *ctx)
+/** Check a packet against its client's rate limits
+ *
+ *  Status-Server and the like are never limited.  Everything else
+ *  counts against the client's authentication or accounting bucket,
+ *  depending on its priority.  Packets over the limit are either
+ *  dropped, or deferred, i.e. sent to a worker with the lowest
+ *  priority, so they're the first to go if the workers are busy.
+ *
+ * @param[in] nr	the network.
+ * @param[in] s		the network socket context.
+ * @param[in] cd	the packet, with its priority set.
+ * @return
+ *	- true if the packet should be sent to a worker.
+ *	- false if it should be dropped.
+ */
+static bool fr_network_rate_limit(fr_network_t *nr, fr_network_socket_t *s, fr_channel_data_t *cd)
+{
+	RADCLIENT *client;
+	fr_rate_limit_t *rl;
+
+	if (!s->listen->app_io->client || (cd->priority == FR_IO_PRIORITY_HIGH)) return true;
+
+	client = s->listen->app_io->client(s->listen->app_io_instance, cd->packet_ctx);
+	if (!client) return true;
+
+	rl = (cd->priority == FR_IO_PRIORITY_NORMAL) ? client->auth_limit : client->acct_limit;
+	if (!rl || fr_rate_limit_admit(rl, cd->m.when)) return true;
+
+	if (s->metrics) fr_metric_inc(s->metrics, NETWORK_METRIC_RATE_LIMITED);
+
+	fr_log(nr->log, L_DBG, "client %s is over its %s rate limit - %s packet",
+	       client->shortname, (cd->priority == FR_IO_PRIORITY_NORMAL) ? "auth" : "accounting",
+	       client->rate_defer ? "deferring" : "dropping");
+
+	if (!client->rate_defer) return false;
+
+	cd->priority = FR_IO_PRIORITY_BACKGROUND;
+	return true;
+}
+
+static int fr_network_read_packet(fr_network_t *nr, fr_network_socket_t *s, int sockfd)
 {
-	fr_network_socket_t *s = ctx;
-	fr_network_t *nr = talloc_parent(s);
 	ssize_t data_size;
 	fr_channel_data_t *cd;
 	fr_time_t *recv_time;
-
-	rad_assert(s->listen->app_io->fd(s->listen->app_io_instance) == sockfd);
-
-	fr_log(nr->log, L_DBG, "network read");
+	bool limited;
 
 	if (!s->cd) {
 		cd = (fr_channel_data_t *) fr_message_reserve(s->ms, s->listen->default_message_size);
 		if (!cd) {
 			fr_log(nr->log, L_ERR, "Failed allocating message size %zd! - Closing socket", s->listen->default_message_size);
-			talloc_free(s);
-			return;
+			fr_network_socket_dead(nr, s);
+			return -1;
 		}
 	} else {
 		cd = s->cd;
@@ -358,16 +662,16 @@ static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED int f
 		 *	blocking issues can happen for stream sockets.
 		 */
 		s->cd = cd;
-		return;
+		return 0;
 	}
 
 	/*
 	 *	Error: close the connection, and remove the fr_listen_t
 	 */
 	if (data_size < 0) {
-		fr_log(nr->log, L_DBG_ERR, "error from transport read on socket %d", sockfd);
-		talloc_free(s);
-		return;
+		fr_log(nr->log, L_DBG_ERR, "error from transport read on socket %d: %s", sockfd, fr_strerror());
+		fr_network_socket_dead(nr, s);
+		return -1;
 	}
 	s->cd = NULL;
 
@@ -381,20 +685,194 @@ static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED int f
 	} else {
 		cd->m.when = fr_time();
 	}
-	cd->priority = 0;
+	cd->priority = FR_IO_PRIORITY_NORMAL;
+	if (s->listen->app->priority) {
+		cd->priority = s->listen->app->priority(s->listen->app_instance, cd->m.data, data_size);
+		if (cd->priority >= FR_IO_PRIORITY_MAX) cd->priority = FR_IO_PRIORITY_BACKGROUND;
+	}
+	limited = !fr_network_rate_limit(nr, s, cd);
+
 	cd->listen = s->listen;
 	cd->request.recv_time = recv_time;
+	cd->request.deadline = 0;
+	if (s->listen->deadline[cd->priority]) cd->request.deadline = cd->m.when + s->listen->deadline[cd->priority];
+
+	FR_PROBE4(network_packet_received, nr, s->listen->name, data_size, cd->m.when);
 
 	(void) fr_message_alloc(s->ms, &cd->m, data_size);
 
+	/*
+	 *	Dropped packets are counted, and logged at debug level.
+	 *	Logging every one would make an overload worse.
+	 */
+	if (s->metrics) fr_metric_inc(s->metrics, NETWORK_METRIC_RECEIVED);
+
+	if (limited) {
+		nr->dropped[FR_NETWORK_DROP_RATE_LIMIT]++;
+		nr->dropped_priority[cd->priority]++;
+		if (s->metrics) fr_metric_inc(s->metrics, NETWORK_METRIC_DROPPED);
+		fr_message_done(&cd->m);
+		return 1;
+	}
+
+	/*
+	 *	The copy is sent first.  Once the packet has gone to
+	 *	a worker, it may be freed at any time.
+	 */
+	if (s->listen->mirror) fr_network_mirror(nr, s, cd);
+
+	/*
+	 *	The trace goes to the worker with the packet, and
+	 *	comes back with the reply.
+	 */
+	cd->trace = NULL;
+	if (fr_trace_sample()) {
+		cd->trace = fr_trace_alloc(NULL, s->listen->name ? s->listen->name : s->listen->app_io->name,
+					   cd->m.when);
+		if (cd->trace) fr_trace_phase(cd->trace, "network.receive", fr_time());
+	}
+
 	if (!fr_network_send_request(nr, cd)) {
-		fr_log(nr->log, L_ERR, "Failed sending packet to worker");
+		if (s->metrics) fr_metric_inc(s->metrics, NETWORK_METRIC_DROPPED);
+		TALLOC_FREE(cd->trace);
 		fr_message_done(&cd->m);
+
+	} else if (s->listen->parent) {
+		s->outstanding++;
 	}
+
+	return 1;
 }
 
-#if 0
-/** Write packets to the network.
+/** Read packets from the network.
+ *
+ *  Transports which set "max_reads" are read repeatedly, until they
+ *  have no more data, or we've read "max_reads" packets.  This lets
+ *  them read a batch of packets with one system call.
+ *
+ * @param[in] el	the event list.
+ * @param[in] sockfd	the socket which is ready to read.
+ * @param[in] flags	from kevent.
+ * @param[in] ctx	the network socket context.
+ */
+static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED int flags, void *ctx)
+{
+	uint32_t i, max_reads;
+	fr_network_socket_t *s = ctx;
+	fr_network_t *nr = talloc_parent(s);
+
+	rad_assert(s->listen->app_io->fd(s->listen->app_io_instance) == sockfd);
+
+	fr_log(nr->log, L_DBG, "network read");
+
+	max_reads = s->listen->app_io->max_reads;
+	if (!max_reads) max_reads = 1;
+
+	for (i = 0; i < max_reads; i++) {
+		int rcode;
+
+		rcode = fr_network_read_packet(nr, s, sockfd);
+		if (rcode < 0) return;		/* the socket may have been freed */
+		if (rcode == 0) break;
+	}
+
+	/*
+	 *	We stopped at "max_reads", but the transport may still
+	 *	have data buffered, e.g. in OpenSSL.  The socket won't
+	 *	become readable again for that, so we read it on the
+	 *	next pass through the event loop, after other sockets
+	 *	have had their turn.
+	 */
+	if ((i == max_reads) && s->listen->app_io->pending &&
+	    (s->listen->app_io->pending(s->listen->app_io_instance) > 0)) {
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		if (fr_event_timer_insert(s, nr->el, &s->read_ev, &now, fr_network_read_pending, s) < 0) {
+			fr_log(nr->log, L_ERR, "Failed scheduling read of buffered data: %s", fr_strerror());
+		}
+	}
+
+	/*
+	 *	Reading from a connection may need us to write to it,
+	 *	e.g. for a TLS handshake.
+	 */
+	if (s->listen->parent) (void) fr_network_flush(nr, s);
+}
+
+/** Read data which the transport buffered when we stopped at "max_reads"
+ *
+ * @param[in] el	the event list.
+ * @param[in] now	the current time.
+ * @param[in] uctx	the network socket context.
+ */
+static void fr_network_read_pending(fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	fr_network_socket_t *s = uctx;
+
+	if (s->dead) return;
+
+	fr_network_read(el, s->listen->app_io->fd(s->listen->app_io_instance), 0, s);
+}
+
+/** Start or stop waiting for a socket to become writable
+ *
+ * @param[in] nr	the network.
+ * @param[in] s		the network socket context.
+ * @param[in] blocked	whether the transport has writes queued.
+ * @return
+ *	- 0 on success.
+ *	- <0 on error.
+ */
+static int fr_network_socket_blocked(fr_network_t *nr, fr_network_socket_t *s, bool blocked)
+{
+	fr_app_io_t const *app_io = s->listen->app_io;
+
+	if (s->blocked == blocked) return 0;
+
+	if (fr_event_fd_insert(nr, nr->el, app_io->fd(s->listen->app_io_instance),
+			       fr_network_read,
+			       blocked ? fr_network_write : NULL,
+			       app_io->error ? fr_network_error : NULL,
+			       s) < 0) {
+		fr_log(nr->log, L_ERR, "Failed updating socket in event loop: %s", fr_strerror());
+		return -1;
+	}
+	s->blocked = blocked;
+
+	return 0;
+}
+
+/** Flush any batched writes for a socket.
+ *
+ *  If the transport couldn't write everything, we wait for the socket
+ *  to become writable, and flush it again then.
+ *
+ * @param[in] ctx	the network.
+ * @param[in] data	the network socket context.
+ * @return 0
+ */
+static int fr_network_flush(void *ctx, void *data)
+{
+	fr_network_t *nr = ctx;
+	fr_network_socket_t *s = data;
+	int rcode;
+
+	if (!s->listen->app_io->flush || s->blocked || s->dead) return 0;
+
+	rcode = s->listen->app_io->flush(s->listen->app_io_instance);
+	if (rcode < 0) {
+		fr_log(nr->log, L_DBG_ERR, "Failed flushing socket %d: %s",
+		       s->listen->app_io->fd(s->listen->app_io_instance), fr_strerror());
+		return 0;
+	}
+
+	if (rcode > 0) (void) fr_network_socket_blocked(nr, s, true);
+
+	return 0;
+}
+
+/** Write queued data to the network.
  *
  * @param el the event list
  * @param sockfd the socket which is ready to write
@@ -404,13 +882,23 @@ static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED int f
 static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUSED int flags, void *ctx)
 {
 	fr_network_socket_t *s = ctx;
+	fr_network_t *nr = talloc_parent(s);
+	int rcode;
 
-	if (s->listen->app_io->flush(s->listen->app_io_instance) < 0) {
-		s->listen->app_io->error(s->listen->app_io_instance);
-		talloc_free(s);
+	rcode = s->listen->app_io->flush(s->listen->app_io_instance);
+	if (rcode < 0) {
+		fr_log(nr->log, L_DBG_ERR, "Failed writing to socket %d: %s", sockfd, fr_strerror());
+		if (s->listen->app_io->error) s->listen->app_io->error(s->listen->app_io_instance);
+		fr_network_socket_dead(nr, s);
+		return;
 	}
+
+	/*
+	 *	Everything has been written, so we don't need to
+	 *	know when the socket is writable any more.
+	 */
+	if (rcode == 0) (void) fr_network_socket_blocked(nr, s, false);
 }
-#endif
 
 /** Handle errors for a socket.
  *
@@ -426,48 +914,70 @@ static void fr_network_error(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 	fr_network_socket_t *s = ctx;
 
 	s->listen->app_io->error(s->listen->app_io_instance);
-	talloc_free(s);
+	fr_network_socket_dead(talloc_parent(s), s);
 }
 
-static int _network_socket_free(fr_network_socket_t *s)
+/** Stop watching a socket, and close it
+ *
+ */
+static void fr_network_socket_close(fr_network_t *nr, fr_network_socket_t *s)
 {
-	fr_network_t *nr = talloc_parent(s);
-
 	fr_event_fd_delete(nr->el, s->listen->app_io->fd(s->listen->app_io_instance));
 
-	rbtree_deletebydata(nr->sockets, s);
-
 	if (s->listen->app_io->close) {
 		s->listen->app_io->close(s->listen->app_io_instance);
 	} else {
 		close(s->listen->app_io->fd(s->listen->app_io_instance));
 	}
+}
+
+/** Close a socket, and free it once nothing refers to it
+ *
+ *  Requests read from a connection refer to its listener and to
+ *  messages in its message set until the worker replies.  So a
+ *  connection with requests outstanding is closed now, but only
+ *  freed when the last reply comes back.
+ *
+ * @param[in] nr	the network.
+ * @param[in] s		the network socket context.
+ */
+static void fr_network_socket_dead(fr_network_t *nr, fr_network_socket_t *s)
+{
+	if (!s->listen->parent || !s->outstanding) {
+		talloc_free(s);
+		return;
+	}
+
+	if (s->dead) return;
+
+	fr_network_socket_close(nr, s);
+	s->dead = true;
+}
+
+static int _network_socket_free(fr_network_socket_t *s)
+{
+	fr_network_t *nr = talloc_parent(s);
+
+	rbtree_deletebydata(nr->sockets, s);
+
+	if (!s->dead) fr_network_socket_close(nr, s);
 
 	return 0;
 }
 
-/** Handle a network control message callback for a new socket
+/** Start reading from a socket
  *
- * @param[in] ctx the network
- * @param[in] data the message
- * @param[in] data_size size of the data
- * @param[in] now the current time
+ * @param[in] nr	the network.
+ * @param[in] s		the network socket context.  Freed on error.
+ * @return
+ *	- 0 on success.
+ *	- <0 on error.
  */
-static void fr_network_socket_callback(void *ctx, void const *data, size_t data_size, UNUSED fr_time_t now)
+static int fr_network_socket_open(fr_network_t *nr, fr_network_socket_t *s)
 {
 	int			fd;
-	fr_network_t		*nr = ctx;
-	fr_network_socket_t	*s;
 	fr_app_io_t const	*app_io;
 
-	rad_assert(data_size == sizeof(*s));
-
-	if (data_size != sizeof(*s)) return;
-
-	s = talloc(nr, fr_network_socket_t);
-	rad_assert(s != NULL);
-	memcpy(s, data, sizeof(*s));
-
 	talloc_set_destructor(s, _network_socket_free);
 
 	/*
@@ -479,29 +989,115 @@ static void fr_network_socket_callback(void *ctx, void const *data, size_t data_
 	if (!s->ms) {
 		fr_log(nr->log, L_ERR, "Failed creating message buffers for network IO.  Closing socket.");
 		talloc_free(s);
-		return;
+		return -1;
 	}
 
 	app_io = s->listen->app_io;
 
+	/*
+	 *	Metrics are nice to have, so we carry on without them.
+	 */
+	s->metrics = fr_metric_set_alloc(s, network_metrics, NETWORK_METRIC_MAX, false);
+	if (s->metrics) {
+		fr_listen_t const *listen = s->listen->parent ? s->listen->parent : s->listen;
+
+		if (fr_metric_set_label(s->metrics, "listener", listen->name ? listen->name : app_io->name) < 0) {
+			TALLOC_FREE(s->metrics);
+
+		} else if (s->listen->parent) {
+			fr_metric_inc(s->metrics, NETWORK_METRIC_CONNECTIONS);
+		}
+	}
+
 	if (app_io->event_list_set) app_io->event_list_set(s->listen->app_io_instance, nr->el);
 
 	rad_assert(app_io->fd);
 	fd = app_io->fd(s->listen->app_io_instance);
 
+	/*
+	 *	Connections use the same app_io as the socket they
+	 *	were accepted on, but are read from.
+	 */
 	if (fr_event_fd_insert(nr, nr->el, fd,
-			       fr_network_read,
-			       NULL,			/* app_io->write ? fr_network_write : NULL - FIXME */
+			       (app_io->accept && !s->listen->parent) ? fr_network_accept : fr_network_read,
+			       NULL,
 			       app_io->error ? fr_network_error : NULL,
 			       s) < 0) {
 		fr_log(nr->log, L_ERR, "Failed adding new socket to event loop: %s", fr_strerror());
 		talloc_free(s);
-		return;
+		return -1;
 	}
 
 	(void) rbtree_insert(nr->sockets, s);
 
 	fr_log(nr->log, L_DBG, "Using new socket with FD %d", fd);
+
+	return 0;
+}
+
+/** Accept a new connection on a listening socket
+ *
+ *  The connection gets its own listener, which is a copy of the
+ *  listening socket's, and its own message set.
+ *
+ * @param[in] el	the event list.
+ * @param[in] sockfd	the listening socket.
+ * @param[in] flags	from kevent.
+ * @param[in] ctx	the network socket context of the listening socket.
+ */
+static void fr_network_accept(UNUSED fr_event_list_t *el, int sockfd, UNUSED int flags, void *ctx)
+{
+	int			rcode;
+	fr_network_socket_t	*s = ctx, *child;
+	fr_network_t		*nr = talloc_parent(s);
+	fr_listen_t		*listen;
+
+	child = talloc_zero(nr, fr_network_socket_t);
+	if (!child) return;
+
+	listen = talloc(child, fr_listen_t);
+	if (!listen) {
+		talloc_free(child);
+		return;
+	}
+
+	memcpy(listen, s->listen, sizeof(*listen));
+	listen->parent = s->listen;
+
+	rcode = s->listen->app_io->accept(&listen->app_io_instance, listen, s->listen->app_io_instance);
+	if (rcode <= 0) {
+		if (rcode < 0) fr_log(nr->log, L_DBG_ERR, "Failed accepting connection on socket %d: %s",
+				      sockfd, fr_strerror());
+		talloc_free(child);
+		return;
+	}
+
+	child->listen = listen;
+
+	(void) fr_network_socket_open(nr, child);
+}
+
+/** Handle a network control message callback for a new socket
+ *
+ * @param[in] ctx the network
+ * @param[in] data the message
+ * @param[in] data_size size of the data
+ * @param[in] now the current time
+ */
+static void fr_network_socket_callback(void *ctx, void const *data, size_t data_size, UNUSED fr_time_t now)
+{
+	fr_network_t		*nr = ctx;
+	fr_network_socket_t	*s;
+
+	rad_assert(data_size == sizeof(*s));
+
+	if (data_size != sizeof(*s)) return;
+
+	s = talloc(nr, fr_network_socket_t);
+	rad_assert(s != NULL);
+	memcpy(s, data, sizeof(*s));
+
+	(void) fr_network_socket_open(nr, s);
 }
 
 
@@ -531,10 +1127,86 @@ static void fr_network_worker_callback(void *ctx, void const *data, size_t data_
 	if (!w->channel) _exit(1);
 
 	fr_channel_master_ctx_add(w->channel, w);
+	fr_channel_master_batch_set(w->channel, true);
 
+	fr_dlist_insert_tail(&nr->worker_list, &w->link);
 	(void) fr_heap_insert(nr->workers, w);
 }
 
+/** Handle a network control message callback for deleting a worker
+ *
+ * @param[in] ctx the network
+ * @param[in] data the message
+ * @param[in] data_size size of the data
+ * @param[in] now the current time
+ */
+static void fr_network_worker_delete_callback(void *ctx, void const *data, size_t data_size, UNUSED fr_time_t now)
+{
+	fr_network_t *nr = ctx;
+	fr_worker_t *worker;
+	fr_dlist_t *entry;
+
+	rad_assert(data_size == sizeof(worker));
+
+	memcpy(&worker, data, data_size);
+
+	for (entry = FR_DLIST_FIRST(nr->worker_list);
+	     entry != NULL;
+	     entry = FR_DLIST_NEXT(nr->worker_list, entry)) {
+		fr_network_worker_t *w;
+
+		w = fr_ptr_to_type(fr_network_worker_t, link, entry);
+		if (w->worker != worker) continue;
+
+		fr_log(nr->log, L_DBG, "closing channel to worker");
+		fr_network_worker_close(nr, w);
+		return;
+	}
+}
+
+static int _network_socket_memory(void *ctx, void *data)
+{
+	size_t			*size = ctx;
+	fr_network_socket_t	*s = data;
+
+	if (s->ms) *size += talloc_total_size(s->ms);
+
+	return 0;
+}
+
+/** Handle a network control message callback for a statistics snapshot
+ *
+ * @param[in] ctx the network
+ * @param[in] data the message
+ * @param[in] data_size size of the data
+ * @param[in] now the current time
+ */
+static void fr_network_stats_callback(void *ctx, void const *data, size_t data_size, UNUSED fr_time_t now)
+{
+	fr_network_t *nr = ctx;
+	fr_control_stats_t msg;
+
+	rad_assert(data_size == sizeof(msg));
+
+	memcpy(&msg, data, data_size);
+
+	fr_network_stats(nr, msg.stats);
+
+	/*
+	 *	fr_network_stats() may be called from other threads,
+	 *	but only this one allocates in the message sets, so
+	 *	they're measured here.
+	 */
+	if (nr->memory) {
+		size_t size = 0;
+
+		(void) rbtree_walk(nr->sockets, RBTREE_IN_ORDER, _network_socket_memory, &size);
+		fr_memory_update(nr->memory, &nr->memory_used, size);
+	}
+
+	msg.done(msg.uctx);
+}
+
 
 /** Service a control-plane event.
  *
@@ -579,6 +1251,14 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t c
 	nr->el = el;
 	nr->log = logger;
 
+	fr_network_max_outstanding_set(nr, NETWORK_MAX_OUTSTANDING);
+
+	/*
+	 *	The network works without memory accounting, so
+	 *	failing to allocate it isn't fatal.
+	 */
+	nr->memory = fr_memory_alloc(nr, "message_set", "network");
+
 	nr->kq = fr_event_list_kq(nr->el);
 	rad_assert(nr->kq >= 0);
 
@@ -628,6 +1308,16 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t c
 		goto fail2;
 	}
 
+	if (fr_control_callback_add(nr->control, FR_CONTROL_ID_WORKER_DELETE, nr, fr_network_worker_delete_callback) < 0) {
+		fr_strerror_printf("Failed adding worker callback: %s", fr_strerror());
+		goto fail2;
+	}
+
+	if (fr_control_callback_add(nr->control, FR_CONTROL_ID_STATS, nr, fr_network_stats_callback) < 0) {
+		fr_strerror_printf("Failed adding stats callback: %s", fr_strerror());
+		goto fail2;
+	}
+
 	/*
 	 *	Create the various heaps.
 	 */
@@ -637,6 +1327,9 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t c
 		goto fail2;
 	}
 
+	FR_DLIST_INIT(nr->flush);
+	FR_DLIST_INIT(nr->worker_list);
+
 	nr->replies = fr_heap_create(reply_cmp, offsetof(fr_channel_data_t, channel.heap_id));
 	if (!nr->replies) {
 		fr_strerror_printf("Failed creating heap for replies: %s", fr_strerror());
@@ -690,13 +1383,19 @@ int fr_network_destroy(fr_network_t *nr)
 	(void) talloc_get_type_abort(nr, fr_network_t);
 	rad_assert(nr->closing);
 
+	/*
+	 *	Workers which have already exited have told us that
+	 *	their channels are closed.  Process that, so that we
+	 *	don't signal workers which no longer exist.
+	 */
+	fr_network_evfilt_user(nr->kq, NULL, nr);
+
 	/*
 	 *	Pop all of the workers, and signal them that we're
 	 *	closing/
 	 */
-	while ((worker = fr_heap_pop(nr->workers)) != NULL) {
-		fr_channel_signal_worker_close(worker->channel);
-		(void) fr_heap_insert(nr->closing, worker);
+	while ((worker = fr_heap_peek(nr->workers)) != NULL) {
+		fr_network_worker_close(nr, worker);
 	}
 
 	/*
@@ -711,6 +1410,7 @@ int fr_network_destroy(fr_network_t *nr)
 	 *	it knows the replies are done, too.
 	 */
 	while ((cd = fr_heap_pop(nr->replies)) != NULL) {
+		talloc_free(cd->trace);
 		fr_message_done(&cd->m);
 	}
 
@@ -730,13 +1430,67 @@ int fr_network_destroy(fr_network_t *nr)
 static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
 {
 	fr_channel_data_t *cd;
+	fr_dlist_t *entry;
+	uint64_t num_written = 0;
 	fr_network_t *nr = talloc_get_type_abort(uctx, fr_network_t);
 
+	/*
+	 *	Wake up the workers we've sent requests to.  This is
+	 *	one signal per worker for all of the packets we read
+	 *	in this pass, instead of one signal per packet.
+	 */
+	while ((entry = FR_DLIST_FIRST(nr->flush)) != NULL) {
+		fr_network_worker_t *w;
+
+		w = fr_ptr_to_type(fr_network_worker_t, entry, entry);
+		fr_dlist_remove(entry);
+		w->flush = false;
+
+		if (fr_channel_master_flush(w->channel) < 0) {
+			fr_log(nr->log, L_DBG_ERR, "Failed signaling worker: %s", fr_strerror());
+		}
+	}
+
 	while ((cd = fr_heap_pop(nr->replies)) != NULL) {
 		ssize_t rcode;
 		fr_listen_t const *listen;
+		fr_network_worker_t *w;
+		fr_network_socket_t my_socket, *s;
+		fr_trace_t *trace;
 
 		listen = cd->listen;
+		w = fr_channel_master_ctx_get(cd->channel.ch);
+		trace = cd->trace;	/* cd may be reused once it's done */
+
+		/*
+		 *	Replies to mirrored packets are discarded.
+		 *	The shadow listener has no socket, and the
+		 *	packet_ctx is our copy.
+		 */
+		if (listen->shadow) {
+			talloc_free(cd->packet_ctx);
+			fr_message_done(&cd->m);
+			goto done;
+		}
+
+		my_socket.listen = listen;
+		s = rbtree_finddata(nr->sockets, &my_socket);
+
+		/*
+		 *	Connections may have been closed while the
+		 *	worker was processing the request.  Their
+		 *	replies are discarded, and the connection is
+		 *	freed after the last one.
+		 */
+		if (listen->parent && s) {
+			s->outstanding--;
+
+			if (s->dead) {
+				fr_message_done(&cd->m);
+				if (!s->outstanding) talloc_free(s);
+				goto done;
+			}
+		}
 
 		/*
 		 *	The write function is responsible for ensuring
@@ -745,8 +1499,6 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED struct time
 		rcode = listen->app_io->write(listen->app_io_instance, cd->packet_ctx,
 					      cd->reply.request_time, cd->m.data, cd->m.data_size);
 		if (rcode < 0) {
-			fr_network_socket_t my_socket, *s;
-
 			/*
 			 *	Tell the socket that there was an error.
 			 *
@@ -755,10 +1507,11 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED struct time
 			 */
 			if (listen->app_io->error) listen->app_io->error(listen->app_io_instance);
 
-			my_socket.listen = listen;
-			s = rbtree_finddata(nr->sockets, &my_socket);
-			if (s) talloc_free(s);
-			continue;
+			if (s) {
+				if (s->metrics) fr_metric_inc(s->metrics, NETWORK_METRIC_WRITE_ERRORS);
+				fr_network_socket_dead(nr, s);
+			}
+			goto done;
 		}
 
 		if ((size_t) rcode < cd->m.data_size) {
@@ -768,7 +1521,27 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED struct time
 		fr_log(nr->log, L_DBG, "Sending reply to socket %d",
 		       cd->listen->app_io->fd(cd->listen->app_io_instance));
 		fr_message_done(&cd->m);
+		num_written++;
+		if (s && s->metrics) fr_metric_inc(s->metrics, NETWORK_METRIC_SENT);
+
+	done:
+		if (trace) {
+			fr_trace_phase(trace, "network.send", fr_time());
+			fr_trace_submit(trace, trace->mark);
+		}
+
+		/*
+		 *	That was the last reply from a closed channel,
+		 *	so nothing refers to the channel any more.
+		 */
+		if ((--w->num_replies == 0) && w->closed) talloc_free(w);
 	}
+
+	/*
+	 *	Transports may queue replies, and write them all at
+	 *	once.  Tell them to write the queued replies now.
+	 */
+	if (num_written) (void) rbtree_walk(nr->sockets, RBTREE_IN_ORDER, fr_network_flush, nr);
 }
 
 
@@ -797,13 +1570,17 @@ void fr_network(fr_network_t *nr)
 		fr_log(nr->log, L_DBG, "Got num_events %d", num_events);
 		if (num_events < 0) break;
 
+		(void) fr_time_coarse_update();
+
 		/*
-		 *	Service outstanding events.
+		 *	Service outstanding events.  We do this even
+		 *	if there are no new events, so that work
+		 *	which was queued without a signal (e.g.
+		 *	replies) is processed, and deferred signals
+		 *	are flushed.
 		 */
-		if (num_events > 0) {
-			fr_log(nr->log, L_DBG, "servicing events");
-			fr_event_service(nr->el);
-		}
+		fr_log(nr->log, L_DBG, "servicing events");
+		fr_event_service(nr->el);
 	}
 }
 
@@ -856,3 +1633,100 @@ int fr_network_worker_add(fr_network_t *nr, fr_worker_t *worker)
 
 	return rcode;
 }
+
+/** Stop sending packets to a worker, and close the channel to it
+ *
+ *  The worker should already have been told to retire, via
+ *  fr_worker_retire().  Requests which have already been sent to
+ *  the worker are still processed, and their replies are still
+ *  sent.
+ *
+ * @param nr the network
+ * @param worker the worker
+ */
+int fr_network_worker_delete(fr_network_t *nr, fr_worker_t *worker)
+{
+	int rcode;
+
+	(void) talloc_get_type_abort(nr, fr_network_t);
+
+	PTHREAD_MUTEX_LOCK(&nr->mutex);
+	rcode = fr_control_message_send(nr->control, nr->rb, FR_CONTROL_ID_WORKER_DELETE, &worker, sizeof(worker));
+	PTHREAD_MUTEX_UNLOCK(&nr->mutex);
+
+	return rcode;
+}
+
+/** Set the watermarks for dropping packets
+ *
+ *  Normal priority packets are dropped when the least loaded worker
+ *  has max_outstanding requests outstanding.  Low priority packets are
+ *  dropped at 3/4 of that, and background packets at 1/2.  High
+ *  priority packets are only dropped if no worker will take them.
+ *
+ *  Must be called before the network starts running, or from the
+ *  network thread.
+ *
+ * @param nr the network
+ * @param max_outstanding the watermark for normal priority packets
+ */
+void fr_network_max_outstanding_set(fr_network_t *nr, int max_outstanding)
+{
+	(void) talloc_get_type_abort(nr, fr_network_t);
+
+	if (max_outstanding < 4) max_outstanding = 4;
+
+	nr->watermark[FR_IO_PRIORITY_HIGH] = INT_MAX;
+	nr->watermark[FR_IO_PRIORITY_NORMAL] = max_outstanding;
+	nr->watermark[FR_IO_PRIORITY_LOW] = (max_outstanding * 3) / 4;
+	nr->watermark[FR_IO_PRIORITY_BACKGROUND] = max_outstanding / 2;
+}
+
+/** Get the request and drop counters for a network
+ *
+ *  This may be called from another thread, in which case the figures
+ *  may be slightly out of date, and may not be consistent with each
+ *  other.  Use fr_network_stats_request() for a consistent snapshot.
+ *
+ * @param nr the network
+ * @param[out] stats where the counters are written
+ */
+void fr_network_stats(fr_network_t *nr, fr_network_stats_t *stats)
+{
+	(void) talloc_get_type_abort(nr, fr_network_t);
+
+	stats->num_requests = nr->num_requests;
+	stats->num_replies = nr->num_replies;
+	memcpy(stats->dropped, nr->dropped, sizeof(stats->dropped));
+	memcpy(stats->dropped_priority, nr->dropped_priority, sizeof(stats->dropped_priority));
+
+	stats->num_sockets = rbtree_num_elements(nr->sockets);
+	stats->num_workers = fr_heap_num_elements(nr->workers);
+	stats->num_closing = fr_heap_num_elements(nr->closing);
+	stats->num_pending = fr_heap_num_elements(nr->replies);
+}
+
+/** Ask the network thread for a snapshot of its statistics
+ *
+ *  The network thread fills in a fr_network_stats_t, between
+ *  servicing events, so the figures are consistent with each other.
+ *
+ * @param nr the network
+ * @param msg where the statistics are written, and who to tell when
+ *	they have been.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_network_stats_request(fr_network_t *nr, fr_control_stats_t *msg)
+{
+	int rcode;
+
+	(void) talloc_get_type_abort(nr, fr_network_t);
+
+	PTHREAD_MUTEX_LOCK(&nr->mutex);
+	rcode = fr_control_message_send(nr->control, nr->rb, FR_CONTROL_ID_STATS, msg, sizeof(*msg));
+	PTHREAD_MUTEX_UNLOCK(&nr->mutex);
+
+	return rcode;
+}
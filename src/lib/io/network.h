@@ -26,6 +26,7 @@
 RCSIDH(network_h, "$Id$")
 
 #include <freeradius-devel/fr_log.h>
+#include <freeradius-devel/io/io.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -33,6 +34,30 @@ extern "C" {
 
 typedef struct fr_network_t fr_network_t;
 
+/**
+ *  Why the network thread dropped a packet, instead of sending it to
+ *  a worker.
+ */
+typedef enum fr_network_drop_t {
+	FR_NETWORK_DROP_NO_WORKERS = 0,		//!< there were no workers
+	FR_NETWORK_DROP_OVERLOAD,		//!< the workers were over the watermark for the packet's priority
+	FR_NETWORK_DROP_CHANNEL_FULL,		//!< every worker channel refused the packet
+	FR_NETWORK_DROP_RATE_LIMIT,		//!< the client was over its rate limit
+	FR_NETWORK_DROP_MAX
+} fr_network_drop_t;
+
+typedef struct fr_network_stats_t {
+	uint64_t		num_requests;		//!< number of requests sent to workers
+	uint64_t		num_replies;		//!< number of replies received from workers
+	uint64_t		dropped[FR_NETWORK_DROP_MAX]; //!< packets dropped, by reason
+	uint64_t		dropped_priority[FR_IO_PRIORITY_MAX]; //!< packets dropped, by priority
+
+	int			num_sockets;		//!< number of sockets we're reading from
+	int			num_workers;		//!< number of workers we can send requests to
+	int			num_closing;		//!< number of workers whose channels are closing
+	int			num_pending;		//!< replies from workers which we haven't yet written
+} fr_network_stats_t;
+
 fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t const *logger) CC_HINT(nonnull(2,3));
 void fr_network_exit(fr_network_t *nr) CC_HINT(nonnull);
 int fr_network_destroy(fr_network_t *nr) CC_HINT(nonnull);
@@ -40,6 +65,11 @@ void fr_network(fr_network_t *nr) CC_HINT(nonnull);
 
 int fr_network_socket_add(fr_network_t *nr, fr_listen_t const *io) CC_HINT(nonnull);
 int fr_network_worker_add(fr_network_t *nr, fr_worker_t *worker) CC_HINT(nonnull);
+int fr_network_worker_delete(fr_network_t *nr, fr_worker_t *worker) CC_HINT(nonnull);
+
+void fr_network_max_outstanding_set(fr_network_t *nr, int max_outstanding) CC_HINT(nonnull);
+void fr_network_stats(fr_network_t *nr, fr_network_stats_t *stats) CC_HINT(nonnull);
+int fr_network_stats_request(fr_network_t *nr, fr_control_stats_t *msg) CC_HINT(nonnull);
 
 #ifdef __cplusplus
 }
@@ -221,8 +221,7 @@ done:
  */
 int fr_queue_localize_atomic(fr_queue_t *fq, fr_atomic_queue_t *aq)
 {
-	void *data;
-	int i, room;
+	int i, room, popped;
 
 	(void) talloc_get_type_abort(fq, fr_queue_t);
 
@@ -233,20 +232,27 @@ int fr_queue_localize_atomic(fr_queue_t *fq, fr_atomic_queue_t *aq)
 	if (!room) return 0;
 
 	/*
-	 *	Pop as many entries as we have room for.
+	 *	Pop as many entries as we have room for, straight
+	 *	into the free part of the ring.  That is at most two
+	 *	contiguous ranges: up to the end of the array, and
+	 *	then from the start.
 	 */
-	for (i = 0; i < room; i++) {
-		if (!fr_atomic_queue_pop(aq, &data)) {
-			return i;
-		}
+	for (i = 0; i < room; i += popped) {
+		int num;
 
-		fq->entry[fq->head++] = data;
+		num = room - i;
+		if (num > (fq->size - fq->head)) num = fq->size - fq->head;
+
+		popped = fr_atomic_queue_pop_n(aq, &fq->entry[fq->head], num);
+		if (!popped) break;
+
+		fq->head += popped;
 		if (fq->head >= fq->size) fq->head = 0;
-		fq->num++;
+		fq->num += popped;
 		rad_assert(fq->num <= fq->size);
 	}
 
-	return room;
+	return i;
 }
 
 #ifndef NDEBUG
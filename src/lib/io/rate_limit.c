@@ -0,0 +1,96 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Token buckets, which may be shared by several threads.
+ * @file io/rate_limit.c
+ *
+ * A client may send packets to more than one network thread, so its
+ * buckets are shared.  They're updated with atomic instructions, and
+ * never take a lock.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/io/rate_limit.h>
+
+/** Allocate a token bucket
+ *
+ * @param[in] ctx	to allocate the bucket in.
+ * @param[in] rate	tokens a second.  Must be more than 0.
+ * @param[in] burst	size of the bucket.  0 means the same as "rate",
+ *			i.e. one second's worth of packets.
+ * @return
+ *	- NULL on error.
+ *	- the new bucket.  It starts off full.
+ */
+fr_rate_limit_t *fr_rate_limit_alloc(TALLOC_CTX *ctx, uint32_t rate, uint32_t burst)
+{
+	fr_rate_limit_t *rl;
+
+	if (!rate) {
+		fr_strerror_printf("Rate must be more than 0");
+		return NULL;
+	}
+
+	if (!burst) burst = rate;
+
+	rl = talloc_zero(ctx, fr_rate_limit_t);
+	if (!rl) return NULL;
+
+	rl->interval = NANOSEC / rate;
+	if (!rl->interval) rl->interval = 1;
+	rl->tolerance = rl->interval * (burst - 1);
+
+	atomic_init(&rl->full, 0);
+	atomic_init(&rl->limited, 0);
+
+	return rl;
+}
+
+/** Take a token from a bucket
+ *
+ * @param[in] rl	the bucket.
+ * @param[in] now	the time the packet was received.
+ * @return
+ *	- true if there was a token.
+ *	- false if the bucket is empty.  The packet is counted.
+ */
+bool fr_rate_limit_admit(fr_rate_limit_t *rl, fr_time_t now)
+{
+	unsigned long long full = atomic_load_explicit(&rl->full, memory_order_relaxed);
+	fr_time_t start;
+
+	do {
+		/*
+		 *	A bucket which filled up in the past is
+		 *	just full.
+		 */
+		start = (full > now) ? full : now;
+
+		if ((start - now) > rl->tolerance) {
+			atomic_fetch_add_explicit(&rl->limited, 1, memory_order_relaxed);
+			return false;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&rl->full, &full, start + rl->interval,
+							memory_order_relaxed, memory_order_relaxed));
+
+	return true;
+}
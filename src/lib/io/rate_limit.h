@@ -0,0 +1,59 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_RATE_LIMIT_H
+#define _FR_RATE_LIMIT_H
+/**
+ * $Id$
+ *
+ * @file io/rate_limit.h
+ * @brief Token buckets, which may be shared by several threads.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSIDH(rate_limit_h, "$Id$")
+
+#include <talloc.h>
+
+#include <freeradius-devel/io/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ *  A token bucket.
+ *
+ *  It holds "burst" tokens, and gains "rate" of them a second.  Each
+ *  packet takes one.  Instead of counting tokens, we keep the time
+ *  at which the bucket would be full again, so the whole bucket is
+ *  one word, and is updated with a compare and swap.
+ */
+typedef struct fr_rate_limit_t {
+	fr_time_t		interval;	//!< between tokens.
+	fr_time_t		tolerance;	//!< how far ahead of now "full" may be, i.e.
+						///< the time to earn burst - 1 tokens.
+	atomic_ullong		full;		//!< when the bucket will be full again.
+	atomic_ullong		limited;	//!< packets which found the bucket empty.
+} fr_rate_limit_t;
+
+fr_rate_limit_t	*fr_rate_limit_alloc(TALLOC_CTX *ctx, uint32_t rate, uint32_t burst);
+bool		fr_rate_limit_admit(fr_rate_limit_t *rl, fr_time_t now) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -28,6 +28,20 @@ RCSID("$Id$")
 #include <freeradius-devel/fr_log.h>
 #include <freeradius-devel/rad_assert.h>
 #include <string.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+/*
+ *	The default huge page size on x86_64 and aarch64.  Ring
+ *	buffers smaller than this always come from talloc, as they
+ *	would waste most of a huge page.
+ */
+#define FR_RING_BUFFER_HUGE_PAGE_SIZE	(2 * 1024 * 1024)
 
 /*
  *	Ring buffers are allocated in a block.
@@ -43,8 +57,120 @@ struct fr_ring_buffer_t {
 	size_t		reserved;	//!< amount of reserved data at write_offset
 
 	bool		closed;		//!< whether allocations are closed
+
+	size_t		mapped;		//!< Size of the mmap'd region, or 0 if "buffer" is talloc'd.
+	fr_ring_buffer_pages_t	pages;	//!< What kind of pages back "buffer".
 };
 
+/*
+ *	Ring buffers are created by all of the threads, so the
+ *	settings and counters are shared.
+ */
+static fr_ring_buffer_pages_t	ring_buffer_pages = FR_RING_BUFFER_PAGES_NORMAL;
+static atomic_size_t		ring_buffer_huge;
+static atomic_size_t		ring_buffer_transparent;
+static atomic_size_t		ring_buffer_fallback;
+
+/** Set what kind of pages back large ring buffers
+ *
+ *  This affects only ring buffers which are created after the call.
+ *  It should be called before any threads are started.
+ *
+ * @param[in] pages	the kind of pages to use.
+ */
+void fr_ring_buffer_pages_set(fr_ring_buffer_pages_t pages)
+{
+	ring_buffer_pages = pages;
+}
+
+/** Get how much ring buffer memory is backed by huge pages
+ *
+ * @param[out] stats	the current totals.
+ */
+void fr_ring_buffer_pages_stats(fr_ring_buffer_pages_stats_t *stats)
+{
+	stats->pages = ring_buffer_pages;
+	stats->huge = atomic_load(&ring_buffer_huge);
+	stats->transparent = atomic_load(&ring_buffer_transparent);
+	stats->fallback = atomic_load(&ring_buffer_fallback);
+}
+
+static int _ring_buffer_free(fr_ring_buffer_t *rb)
+{
+	munmap(rb->buffer, rb->mapped);
+
+	if (rb->pages == FR_RING_BUFFER_PAGES_HUGE) {
+		atomic_fetch_sub(&ring_buffer_huge, rb->mapped);
+	} else {
+		atomic_fetch_sub(&ring_buffer_transparent, rb->mapped);
+	}
+
+	return 0;
+}
+
+/** Map a ring buffer onto huge pages
+ *
+ *  Explicit huge pages have to be reserved by the administrator, so
+ *  if there aren't any left, we fall back to an aligned region which
+ *  the kernel can back with transparent huge pages.
+ *
+ * @return
+ *	- NULL if neither kind of page is available.
+ *	- the mapped buffer.
+ */
+static uint8_t *ring_buffer_map(fr_ring_buffer_t *rb, size_t size)
+{
+	uint8_t		*p;
+	size_t		len;
+
+	len = (size + FR_RING_BUFFER_HUGE_PAGE_SIZE - 1) & ~((size_t) FR_RING_BUFFER_HUGE_PAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+	if (ring_buffer_pages == FR_RING_BUFFER_PAGES_HUGE) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			rb->mapped = len;
+			rb->pages = FR_RING_BUFFER_PAGES_HUGE;
+			atomic_fetch_add(&ring_buffer_huge, len);
+			return p;
+		}
+	}
+#endif
+
+#ifdef MADV_HUGEPAGE
+	{
+		uint8_t		*start;
+		size_t		slop;
+
+		/*
+		 *	Over-allocate so that we can trim the region
+		 *	to a huge page boundary.
+		 */
+		p = mmap(NULL, len + FR_RING_BUFFER_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) return NULL;
+
+		start = (uint8_t *) (((uintptr_t) p + FR_RING_BUFFER_HUGE_PAGE_SIZE - 1) &
+				     ~((uintptr_t) FR_RING_BUFFER_HUGE_PAGE_SIZE - 1));
+		slop = start - p;
+		if (slop) munmap(p, slop);
+		munmap(start + len, FR_RING_BUFFER_HUGE_PAGE_SIZE - slop);
+
+		if (madvise(start, len, MADV_HUGEPAGE) < 0) {
+			munmap(start, len);
+			return NULL;
+		}
+
+		rb->mapped = len;
+		rb->pages = FR_RING_BUFFER_PAGES_TRANSPARENT;
+		atomic_fetch_add(&ring_buffer_transparent, len);
+		return start;
+	}
+#else
+	return NULL;
+#endif
+}
+
 /** Create a ring buffer.
  *
  *  The size provided will be rounded up to the next highest power of
@@ -55,6 +181,9 @@ struct fr_ring_buffer_t {
  *  tracking the start of the reservation, *and* it's write offset
  *  within that reservation.
  *
+ *  Ring buffers of 2MB or more are backed by huge pages, if that
+ *  was enabled with fr_ring_buffer_pages_set().
+ *
  * @param[in] ctx	a talloc context
  * @param[in] size	of the raw ring buffer array to allocate.
  * @return
@@ -82,6 +211,21 @@ fr_ring_buffer_t *fr_ring_buffer_create(TALLOC_CTX *ctx, size_t size)
 	size = pow;
 	size--;
 
+	/*
+	 *	Large ring buffers are spread over many pages, which
+	 *	thrashes the TLB.  So we can put them on huge pages.
+	 */
+	if ((ring_buffer_pages != FR_RING_BUFFER_PAGES_NORMAL) && (pow >= FR_RING_BUFFER_HUGE_PAGE_SIZE)) {
+		rb->buffer = ring_buffer_map(rb, pow);
+		if (rb->buffer) {
+			talloc_set_destructor(rb, _ring_buffer_free);
+			rb->size = size;
+			return rb;
+		}
+
+		atomic_fetch_add(&ring_buffer_fallback, 1);
+	}
+
 	rb->buffer = talloc_array(rb, uint8_t, size);
 	if (!rb->buffer) {
 		talloc_free(rb);
@@ -36,6 +36,28 @@ extern "C" {
 
 typedef struct fr_ring_buffer_t fr_ring_buffer_t;
 
+/** What kind of pages back large ring buffers
+ *
+ */
+typedef enum fr_ring_buffer_pages_t {
+	FR_RING_BUFFER_PAGES_NORMAL = 0,	//!< talloc'd memory.
+	FR_RING_BUFFER_PAGES_TRANSPARENT,	//!< Aligned mmap, with madvise(MADV_HUGEPAGE).
+	FR_RING_BUFFER_PAGES_HUGE		//!< MAP_HUGETLB, falling back to transparent huge pages.
+} fr_ring_buffer_pages_t;
+
+/** How much ring buffer memory is on huge pages
+ *
+ */
+typedef struct fr_ring_buffer_pages_stats_t {
+	fr_ring_buffer_pages_t	pages;		//!< The current setting.
+	size_t			huge;		//!< Bytes on explicit huge pages.
+	size_t			transparent;	//!< Bytes on regions advised for transparent huge pages.
+	size_t			fallback;	//!< Number of ring buffers which fell back to talloc.
+} fr_ring_buffer_pages_stats_t;
+
+void fr_ring_buffer_pages_set(fr_ring_buffer_pages_t pages);
+void fr_ring_buffer_pages_stats(fr_ring_buffer_pages_stats_t *stats) CC_HINT(nonnull);
+
 fr_ring_buffer_t *fr_ring_buffer_create(TALLOC_CTX *ctx, size_t size);
 
 uint8_t *fr_ring_buffer_reserve(fr_ring_buffer_t *rb, size_t size) CC_HINT(nonnull);
@@ -42,6 +42,12 @@ RCSID("$Id$")
 
 #define SEMAPHORE_LOCKED	(0)
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 #ifdef __APPLE__
 #include <mach/task.h>
 #include <mach/mach_init.h>
@@ -57,10 +63,47 @@ RCSID("$Id$")
 #define sem_post(s) semaphore_signal(*s)
 #undef sem_destroy
 #define sem_destroy(s) semaphore_destroy(mach_task_self(),*s)
+#undef sem_trywait
+#define sem_trywait(s) ((semaphore_timedwait(*s, (mach_timespec_t) { 0, 0 }) == KERN_SUCCESS) ? 0 : -1)
 #endif	/* __APPLE__ */
 
 #define SEM_WAIT_INTR(_x) do {if (sem_wait(_x) == 0) break;} while (errno == EINTR)
 
+/*
+ *	How often the manager thread wakes up, in microseconds.
+ *	Changes to the number of workers are made at most once per
+ *	tick.
+ */
+#define SCHEDULE_MANAGER_TICK	(100000)
+
+/*
+ *	How long we wait for the threads to reply to a request for
+ *	statistics, in microseconds.
+ */
+#define SCHEDULE_STATS_WAIT	(1000000)
+
+/*
+ *	Thread placement is only supported where we have
+ *	pthread_setaffinity_np(), and the NUMA topology in /sys.
+ */
+#if defined(HAVE_PTHREAD_H) && defined(__linux__)
+#include <sched.h>
+#define SCHEDULE_AFFINITY (1)
+#define NUMA_NODE_PATH "/sys/devices/system/node/node%d/cpulist"
+#endif
+
+#ifndef CPU_SETSIZE
+#define CPU_SETSIZE (1024)
+#endif
+
+/**
+ *  A list of CPUs.
+ */
+typedef struct fr_schedule_cpus_t {
+	int		num;			//!< number of CPUs in the list
+	int		*cpu;			//!< the CPU numbers
+} fr_schedule_cpus_t;
+
 /**
  *  Track the child thread status.
  */
@@ -80,7 +123,8 @@ typedef struct fr_schedule_worker_t {
 
 	int		id;			//!< a unique ID
 	int		uses;			//!< how many network threads are using it
-	fr_time_t	cpu_time;		//!< how much CPU time this worker has used
+	fr_time_t	cpu_time;		//!< how much CPU time this worker had used, when we last checked
+	bool		retiring;		//!< we've told the worker to exit once it's idle
 
 	fr_dlist_t	entry;			//!< our entry into the linked list of workers
 
@@ -88,6 +132,8 @@ typedef struct fr_schedule_worker_t {
 
 	fr_schedule_child_status_t status;	//!< status of the worker
 	fr_worker_t	*worker;		//!< the worker data structure
+
+	fr_schedule_cpus_t cpus;		//!< CPUs this worker may run on
 } fr_schedule_worker_t;
 
 /**
@@ -101,6 +147,9 @@ typedef struct fr_schedule_network_t {
 
 	fr_schedule_child_status_t status;	//!< status of the worker
 	fr_network_t	*rc;			//!< the receive data structure
+
+	fr_schedule_cpus_t cpus;		//!< CPUs this network may run on
+	int		node;			//!< NUMA node of this network, or -1 for "don't care"
 } fr_schedule_network_t;
 
 
@@ -115,13 +164,28 @@ struct fr_schedule_t {
 	fr_log_t	*log;			//!< log destination
 
 	int		max_networks;		//!< number of network threads
+	int		next_network;		//!< network thread for the next socket
 	int		max_workers;		//!< max number of worker threads
+	int		min_workers;		//!< min number of worker threads
 
 	int		num_workers;		//!< number of worker threads
 	int		num_workers_exited;	//!< number of exited workers
 
+	int		target;			//!< number of workers set by the administrator, or 0 for "auto"
+	int		scale_up;		//!< add a worker when they're busier than this percentage
+	int		scale_down;		//!< retire a worker when they're less busy than this percentage
+	int		load;			//!< how busy the workers were in the last interval
+	fr_time_t	interval;		//!< how often we check the load
+	fr_time_t	checked;		//!< when we last checked the load
+
+	fr_schedule_worker_t *retiring;		//!< the worker we're waiting for to exit
+
 #ifdef HAVE_PTHREAD_H
 	sem_t		semaphore;		//!< for inter-thread signaling
+
+	bool		manager;		//!< is the manager thread running?
+	pthread_t	manager_id;		//!< the thread which adds and retires workers
+	pthread_mutex_t	mutex;			//!< protects the list of workers, and the target
 #endif
 
 	fr_schedule_thread_instantiate_t	worker_thread_instantiate;	//!< thread instantiation callback
@@ -134,10 +198,257 @@ struct fr_schedule_t {
 	fr_network_t	*single_network;	//!< for single-threaded mode
 	fr_worker_t	*single_worker;		//!< for single-threaded mode
 
-	fr_schedule_network_t *sn;		//!< pointer to the (one) network thread
+	fr_schedule_network_t *sn;		//!< array of max_networks network threads
+
+	fr_worker_steal_t *steal;		//!< for workers to share surplus messages
+
+	fr_schedule_cpus_t network_cpus;	//!< CPUs for network threads
+	fr_schedule_cpus_t worker_cpus;		//!< CPUs for worker threads
+	bool		numa;			//!< NUMA-aware placement
+
+	int		num_nodes;		//!< number of NUMA nodes
+	fr_schedule_cpus_t *nodes;		//!< CPUs in each NUMA node
 };
 
 
+/** Parse a CPU list
+ *
+ *  The format is the same as for /sys/devices/system/node/node0/cpulist,
+ *  and taskset(1), e.g. "0-3,8,10-11".
+ *
+ * @param[in] ctx	to allocate the CPU array in.
+ * @param[out] out	the parsed list of CPUs.
+ * @param[in] str	the string to parse.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int fr_schedule_cpus_parse(TALLOC_CTX *ctx, fr_schedule_cpus_t *out, char const *str)
+{
+	char const *p = str;
+	char *end;
+	unsigned long first, last, i;
+
+	out->num = 0;
+	out->cpu = NULL;
+
+	while (*p) {
+		while (isspace((int) *p) || (*p == ',')) p++;
+		if (!*p) break;
+
+		first = strtoul(p, &end, 10);
+		if (end == p) {
+		invalid:
+			fr_strerror_printf("Invalid CPU list '%s' at '%s'", str, p);
+			TALLOC_FREE(out->cpu);
+			out->num = 0;
+			return -1;
+		}
+		p = end;
+
+		last = first;
+		if (*p == '-') {
+			p++;
+			last = strtoul(p, &end, 10);
+			if ((end == p) || (last < first)) goto invalid;
+			p = end;
+		}
+
+		if (last >= CPU_SETSIZE) goto invalid;
+
+		if (*p && (*p != ',') && !isspace((int) *p) && (*p != '\n')) goto invalid;
+
+		for (i = first; i <= last; i++) {
+			out->cpu = talloc_realloc(ctx, out->cpu, int, out->num + 1);
+			if (!out->cpu) {
+				fr_strerror_printf("Failed allocating memory");
+				out->num = 0;
+				return -1;
+			}
+			out->cpu[out->num++] = (int) i;
+		}
+	}
+
+	return 0;
+}
+
+/** Check if a CPU is in a CPU list
+ *
+ */
+static bool fr_schedule_cpus_member(fr_schedule_cpus_t const *cpus, int cpu)
+{
+	int i;
+
+	for (i = 0; i < cpus->num; i++) {
+		if (cpus->cpu[i] == cpu) return true;
+	}
+
+	return false;
+}
+
+#ifdef SCHEDULE_AFFINITY
+/** Load the NUMA topology from /sys
+ *
+ * @param[in] sc	the scheduler
+ * @return the number of NUMA nodes found.
+ */
+static int fr_schedule_numa_load(fr_schedule_t *sc)
+{
+	int i;
+
+	for (i = 0; ; i++) {
+		FILE *fp;
+		char path[64];
+		char buffer[1024];
+
+		snprintf(path, sizeof(path), NUMA_NODE_PATH, i);
+
+		fp = fopen(path, "r");
+		if (!fp) break;
+
+		if (!fgets(buffer, sizeof(buffer), fp)) {
+			fclose(fp);
+			break;
+		}
+		fclose(fp);
+
+		sc->nodes = talloc_realloc(sc, sc->nodes, fr_schedule_cpus_t, i + 1);
+		if (!sc->nodes) break;
+
+		if (fr_schedule_cpus_parse(sc->nodes, &sc->nodes[i], buffer) < 0) break;
+	}
+
+	sc->num_nodes = sc->nodes ? i : 0;
+
+	return sc->num_nodes;
+}
+
+/** Find the NUMA node which contains a CPU
+ *
+ */
+static int fr_schedule_numa_node(fr_schedule_t const *sc, int cpu)
+{
+	int i;
+
+	for (i = 0; i < sc->num_nodes; i++) {
+		if (fr_schedule_cpus_member(&sc->nodes[i], cpu)) return i;
+	}
+
+	return -1;
+}
+#endif
+
+/** Decide which CPUs a network thread should run on
+ *
+ *  Called before the thread is spawned, so all of the placement
+ *  decisions are made in one place, by one thread.
+ *
+ * @param[in] sc	the scheduler
+ * @param[in] sn	the network thread
+ */
+static void fr_schedule_network_place(fr_schedule_t *sc, fr_schedule_network_t *sn)
+{
+	sn->node = -1;
+	sn->cpus.num = 0;
+	sn->cpus.cpu = NULL;
+
+	if (sc->network_cpus.num > 0) {
+		sn->cpus.num = 1;
+		sn->cpus.cpu = &sc->network_cpus.cpu[sn->id % sc->network_cpus.num];
+#ifdef SCHEDULE_AFFINITY
+		sn->node = fr_schedule_numa_node(sc, sn->cpus.cpu[0]);
+#endif
+		return;
+	}
+
+	if (!sc->numa || (sc->num_nodes == 0)) return;
+
+	sn->node = sn->id % sc->num_nodes;
+	sn->cpus = sc->nodes[sn->node];
+}
+
+/** Decide which CPUs a worker thread should run on
+ *
+ *  Explicit CPU lists take precedence.  Otherwise in NUMA mode, the
+ *  worker is placed on the node of the network thread it is
+ *  paired with, avoiding any CPU reserved for network threads.
+ *
+ * @param[in] ctx	to allocate the CPU list in.
+ * @param[in] sc	the scheduler
+ * @param[in] sw	the worker thread
+ */
+static void fr_schedule_worker_place(TALLOC_CTX *ctx, fr_schedule_t *sc, fr_schedule_worker_t *sw)
+{
+	int i;
+	fr_schedule_cpus_t const *node;
+
+	sw->cpus.num = 0;
+	sw->cpus.cpu = NULL;
+
+	if (sc->worker_cpus.num > 0) {
+		sw->cpus.num = 1;
+		sw->cpus.cpu = &sc->worker_cpus.cpu[sw->id % sc->worker_cpus.num];
+		return;
+	}
+
+	if (!sc->numa || !sc->sn || (sc->sn[sw->id % sc->max_networks].node < 0)) return;
+
+	node = &sc->nodes[sc->sn[sw->id % sc->max_networks].node];
+
+	sw->cpus.cpu = talloc_array(ctx, int, node->num);
+	if (!sw->cpus.cpu) return;
+
+	for (i = 0; i < node->num; i++) {
+		if (fr_schedule_cpus_member(&sc->network_cpus, node->cpu[i])) continue;
+
+		sw->cpus.cpu[sw->cpus.num++] = node->cpu[i];
+	}
+
+	/*
+	 *	The network threads use all of the CPUs in the node.
+	 *	Share them.
+	 */
+	if (!sw->cpus.num) sw->cpus = *node;
+}
+
+/** Pin the calling thread to a set of CPUs
+ *
+ *  This MUST be called by the thread before it allocates any
+ *  memory.  Linux uses a "first touch" policy, so the event list,
+ *  message sets, and ring buffers for the thread will then be
+ *  allocated from memory local to its NUMA node.
+ *
+ * @param[in] sc	the scheduler
+ * @param[in] type	"Network" or "Worker", for logging.
+ * @param[in] id	of the thread, for logging.
+ * @param[in] cpus	the CPUs the thread will run on.
+ */
+static void fr_schedule_thread_pin(fr_schedule_t *sc, char const *type, int id, fr_schedule_cpus_t const *cpus)
+{
+#ifdef SCHEDULE_AFFINITY
+	int i, rcode;
+	cpu_set_t set;
+
+	if (!cpus->num) return;
+
+	CPU_ZERO(&set);
+	for (i = 0; i < cpus->num; i++) CPU_SET(cpus->cpu[i], &set);
+
+	rcode = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (rcode != 0) {
+		fr_log(sc->log, L_WARN, "%s %d - Failed setting CPU affinity: %s", type, id, fr_syserror(rcode));
+		return;
+	}
+
+	if (cpus->num == 1) {
+		fr_log(sc->log, L_DBG, "%s %d - Pinned to CPU %d", type, id, cpus->cpu[0]);
+	} else {
+		fr_log(sc->log, L_DBG, "%s %d - Pinned to %d CPUs starting at %d", type, id, cpus->num, cpus->cpu[0]);
+	}
+#endif
+}
+
+
 /** Initialize and run the worker thread.
  *
  * @param[in] arg the fr_schedule_worker_t
@@ -145,6 +456,7 @@ struct fr_schedule_t {
  */
 static void *fr_schedule_worker_thread(void *arg)
 {
+	int i;
 	fr_schedule_worker_t *sw = arg;
 	fr_schedule_t *sc = sw->sc;
 	fr_schedule_child_status_t status = FR_CHILD_FAIL;
@@ -153,6 +465,8 @@ static void *fr_schedule_worker_thread(void *arg)
 
 	fr_log(sc->log, L_INFO, "Worker %d starting\n", sw->id);
 
+	fr_schedule_thread_pin(sc, "Worker", sw->id, &sw->cpus);
+
 	el = fr_event_list_alloc(sw, NULL, NULL);
 	if (!el) {
 		fr_log(sc->log, L_ERR, "Worker %d - Failed creating event list: %s",
@@ -160,6 +474,12 @@ static void *fr_schedule_worker_thread(void *arg)
 		goto fail;
 	}
 
+	/*
+	 *	Workers have a timer for every request, and most of
+	 *	them are deleted before they fire.
+	 */
+	(void) fr_event_list_timer_wheel(el, true);
+
 	sw->worker = fr_worker_create(sw, el, sc->log, sc->worker_flags);
 	if (!sw->worker) {
 		fr_log(sc->log, L_ERR, "Worker %d - Failed creating worker: %s", sw->id, fr_strerror());
@@ -169,6 +489,13 @@ static void *fr_schedule_worker_thread(void *arg)
 	snprintf(buffer, sizeof(buffer), "thread %d - ", sw->id);
 	fr_worker_name(sw->worker, buffer);
 
+	/*
+	 *	Not fatal.  The worker just won't share messages.
+	 */
+	if (sc->steal && (fr_worker_steal_join(sw->worker, sc->steal, sw->id) < 0)) {
+		fr_log(sc->log, L_WARN, "Worker %d - Failed joining steal group: %s", sw->id, fr_strerror());
+	}
+
 	/*
 	 *	@todo make this a registry
 	 */
@@ -180,7 +507,12 @@ static void *fr_schedule_worker_thread(void *arg)
 
 	sw->status = FR_CHILD_RUNNING;
 
-	(void) fr_network_worker_add(sc->sn->rc, sw->worker);
+	/*
+	 *	Every network thread can send packets to every worker.
+	 */
+	for (i = 0; i < sc->max_networks; i++) {
+		(void) fr_network_worker_add(sc->sn[i].rc, sw->worker);
+	}
 
 	fr_log(sc->log, L_INFO, "Spawned async worker %d", sw->id);
 
@@ -209,6 +541,10 @@ static void *fr_schedule_worker_thread(void *arg)
 	status = FR_CHILD_EXITED;
 
 fail:
+	if (sw->worker) {
+		fr_worker_destroy(sw->worker);
+		sw->worker = NULL;
+	}
 
 	sw->status = status;
 
@@ -238,6 +574,8 @@ static void *fr_schedule_network_thread(void *arg)
 
 	fr_log(sc->log, L_INFO, "Network %d starting\n", sn->id);
 
+	fr_schedule_thread_pin(sc, "Network", sn->id, &sn->cpus);
+
 	ctx = talloc_init("network %d", sn->id);
 	if (!ctx) {
 		fr_log(sc->log, L_ERR, "Network %d - Failed allocating memory", sn->id);
@@ -264,7 +602,7 @@ static void *fr_schedule_network_thread(void *arg)
 	 */
 	sem_post(&sc->semaphore);
 
-	fr_log(sc->log, L_INFO, "Spawned asycn network 0");
+	fr_log(sc->log, L_INFO, "Spawned async network %d", sn->id);
 
 	/*
 	 *	Do all of the work.
@@ -286,7 +624,7 @@ fail:
 
 	sn->status = status;
 
-	fr_log(sc->log, L_INFO, "Network exiting");
+	fr_log(sc->log, L_INFO, "Network %d exiting", sn->id);
 
 	/*
 	 *	Tell the scheduler we're done.
@@ -297,23 +635,284 @@ fail:
 }
 
 
+#ifdef HAVE_PTHREAD_H
+/** Start a worker thread
+ *
+ *  The caller has to wait on the semaphore for the worker to say
+ *  that it's either running, or that it failed.
+ *
+ * @param[in] sc	the scheduler
+ * @param[in] id	of the worker, and its slot in the steal group.
+ * @return
+ *	- NULL on error
+ *	- the new worker
+ */
+static fr_schedule_worker_t *fr_schedule_worker_alloc(fr_schedule_t *sc, int id)
+{
+	int rcode;
+	pthread_attr_t attr;
+	fr_schedule_worker_t *sw;
+
+	/*
+	 *	Create a worker "glue" structure
+	 */
+	sw = talloc_zero(NULL, fr_schedule_worker_t);
+	if (!sw) {
+		fr_log(sc->log, L_ERR, "Worker %d - Failed allocating memory", id);
+		return NULL;
+	}
+
+	sw->id = id;
+	sw->sc = sc;
+	sw->status = FR_CHILD_INITIALIZING;
+	fr_schedule_worker_place(sw, sc, sw);
+
+	(void) pthread_attr_init(&attr);
+	(void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	rcode = pthread_create(&sw->pthread_id, &attr, fr_schedule_worker_thread, sw);
+	(void) pthread_attr_destroy(&attr);
+	if (rcode != 0) {
+		fr_log(sc->log, L_ERR, "Failed creating worker %d: %s\n", id, fr_syserror(rcode));
+		talloc_free(sw);
+		return NULL;
+	}
+
+	fr_dlist_insert_head(&sc->workers, &sw->entry);
+	sc->num_workers++;
+
+	return sw;
+}
+
+/** Add one worker to a running scheduler
+ *
+ *  The new worker takes the lowest free ID, so that it can re-use
+ *  the steal group slot of a worker which has been retired.
+ *
+ * @param[in] sc	the scheduler
+ */
+static void fr_schedule_worker_spawn(fr_schedule_t *sc)
+{
+	int id;
+	fr_dlist_t *entry;
+	fr_schedule_worker_t *sw;
+
+	for (id = 0; id < sc->max_workers; id++) {
+		for (entry = FR_DLIST_FIRST(sc->workers);
+		     entry != NULL;
+		     entry = FR_DLIST_NEXT(sc->workers, entry)) {
+			sw = fr_ptr_to_type(fr_schedule_worker_t, entry, entry);
+			if (sw->id == id) break;
+		}
+
+		if (!entry) break;
+	}
+	if (id == sc->max_workers) return;
+
+	sw = fr_schedule_worker_alloc(sc, id);
+	if (!sw) return;
+
+	SEM_WAIT_INTR(&sc->semaphore);
+	if (sw->status != FR_CHILD_RUNNING) {
+		fr_log(sc->log, L_ERR, "Failed adding worker %d", id);
+		fr_dlist_remove(&sw->entry);
+		sc->num_workers--;
+		talloc_free(sw);
+		return;
+	}
+
+	fr_log(sc->log, L_INFO, "Added worker %d, now %d workers", id, sc->num_workers);
+}
+
+/** Retire one worker
+ *
+ *  The worker with the highest ID is retired, so that the IDs in use
+ *  stay dense.  The networks stop sending it requests, and it exits
+ *  once it has replied to the requests it already has.  Its surplus
+ *  requests may still be stolen by the other workers.
+ *
+ * @param[in] sc	the scheduler
+ */
+static void fr_schedule_worker_retire(fr_schedule_t *sc)
+{
+	int i;
+	fr_dlist_t *entry;
+	fr_schedule_worker_t *sw, *victim = NULL;
+
+	for (entry = FR_DLIST_FIRST(sc->workers);
+	     entry != NULL;
+	     entry = FR_DLIST_NEXT(sc->workers, entry)) {
+		sw = fr_ptr_to_type(fr_schedule_worker_t, entry, entry);
+
+		if ((sw->status != FR_CHILD_RUNNING) || sw->retiring) continue;
+
+		/*
+		 *	The networks haven't yet opened their channels
+		 *	to the worker.  If we retired it now, it could
+		 *	exit before they do.
+		 */
+		if (fr_worker_num_channels(sw->worker) < sc->max_networks) continue;
+
+		if (!victim || (sw->id > victim->id)) victim = sw;
+	}
+	if (!victim) return;
+
+	victim->retiring = true;
+	sc->retiring = victim;
+
+	fr_worker_retire(victim->worker);
+
+	for (i = 0; i < sc->max_networks; i++) {
+		(void) fr_network_worker_delete(sc->sn[i].rc, victim->worker);
+	}
+
+	fr_log(sc->log, L_INFO, "Retiring worker %d", victim->id);
+}
+
+/** Clean up a retired worker, if it has exited
+ *
+ *  We only ever retire one worker at a time, and we don't add
+ *  workers while one is retiring.  So the only thread which can
+ *  post the semaphore is the retiring worker.
+ *
+ * @param[in] sc	the scheduler
+ */
+static void fr_schedule_worker_reap(fr_schedule_t *sc)
+{
+	fr_schedule_worker_t *sw = sc->retiring;
+
+	if (!sw) return;
+
+	if (sem_trywait(&sc->semaphore) != 0) return;
+
+	fr_dlist_remove(&sw->entry);
+	sc->num_workers--;
+	sc->retiring = NULL;
+
+	fr_log(sc->log, L_INFO, "Retired worker %d, now %d workers", sw->id, sc->num_workers);
+
+	talloc_free(sw);
+}
+
+/** Calculate how busy the workers have been since we last checked
+ *
+ * @param[in] sc	the scheduler
+ * @param[in] now	the current time
+ */
+static void fr_schedule_worker_load(fr_schedule_t *sc, fr_time_t now)
+{
+	int num = 0;
+	uint64_t busy = 0;
+	fr_time_t elapsed;
+	fr_dlist_t *entry;
+
+	elapsed = now - sc->checked;
+	sc->checked = now;
+
+	for (entry = FR_DLIST_FIRST(sc->workers);
+	     entry != NULL;
+	     entry = FR_DLIST_NEXT(sc->workers, entry)) {
+		fr_time_t running;
+		fr_schedule_worker_t *sw;
+
+		sw = fr_ptr_to_type(fr_schedule_worker_t, entry, entry);
+
+		if ((sw->status != FR_CHILD_RUNNING) || sw->retiring) continue;
+
+		running = fr_worker_running_time(sw->worker);
+		busy += running - sw->cpu_time;
+		sw->cpu_time = running;
+		num++;
+	}
+
+	if (!num || !elapsed) return;
+
+	sc->load = (busy * 100) / (elapsed * num);
+
+	fr_log(sc->log, L_DBG, "Workers are %d%% busy", sc->load);
+}
+
+/** Add and retire workers
+ *
+ *  This thread is the only one which changes the list of workers
+ *  after the scheduler has been created.
+ *
+ * @param[in] arg the fr_schedule_t
+ * @return NULL
+ */
+static void *fr_schedule_manager_thread(void *arg)
+{
+	fr_schedule_t *sc = arg;
+
+	while (true) {
+		int want, num_active;
+		fr_time_t now;
+
+		usleep(SCHEDULE_MANAGER_TICK);
+
+		pthread_mutex_lock(&sc->mutex);
+		if (!sc->running) {
+			pthread_mutex_unlock(&sc->mutex);
+			break;
+		}
+
+		fr_schedule_worker_reap(sc);
+
+		num_active = sc->num_workers - (sc->retiring != NULL);
+		want = sc->target;
+
+		now = fr_time();
+		if ((now - sc->checked) >= sc->interval) {
+			fr_schedule_worker_load(sc, now);
+
+			if (!want) {
+				want = num_active;
+
+				if (sc->load > sc->scale_up) {
+					want++;
+				} else if (sc->load < sc->scale_down) {
+					want--;
+				}
+
+				if (want < sc->min_workers) want = sc->min_workers;
+				if (want > sc->max_workers) want = sc->max_workers;
+			}
+		}
+
+		if (want && !sc->retiring) {
+			if (want > num_active) {
+				fr_schedule_worker_spawn(sc);
+
+			} else if (want < num_active) {
+				fr_schedule_worker_retire(sc);
+			}
+		}
+
+		pthread_mutex_unlock(&sc->mutex);
+	}
+
+	return NULL;
+}
+#endif
+
 /** Create a scheduler and spawn the child threads.
  *
  * @param[in] ctx the talloc context
  * @param[in] el the event list, only for single-threaded mode.
  * @param[in] logger the destination for all logging messages
  * @param[in] max_networks the number of network threads
- * @param[in] max_workers the number of worker threads
+ * @param[in] num_workers the number of worker threads to start with
  * @param[in] worker_thread_instantiate callback for new worker threads
  * @param[in] worker_thread_ctx context for callback
+ * @param[in] config thread placement, or NULL to let the OS decide.
  * @return
  *	- NULL on error
  *	- fr_schedule_t new scheduler
  */
 fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t *logger,
-				  int max_networks, int max_workers,
+				  int max_networks, int num_workers,
 				  fr_schedule_thread_instantiate_t worker_thread_instantiate,
-				  void *worker_thread_ctx)
+				  void *worker_thread_ctx, fr_schedule_config_t const *config)
 {
 #ifdef HAVE_PTHREAD_H
 	int i;
@@ -327,7 +926,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t
 	 *	Single-threaded mode MUST have event list, and zero
 	 *	networks or workers
 	 */
-	if (el && (max_networks || max_workers)) {
+	if (el && (max_networks || num_workers)) {
 		fr_strerror_printf("Cannot specify event list and networks or workers");
 		return NULL;
 	}
@@ -336,7 +935,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t
 	 *	Multi-threaded mode must NOT have an event list, and
 	 *	non-zero networks and workers.
 	 */
-	if (!el && (!max_networks || !max_workers)) {
+	if (!el && (!max_networks || !num_workers)) {
 		fr_strerror_printf("Must specify the number of networks and workers");
 		return NULL;
 	}
@@ -349,7 +948,8 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t
 
 	sc->el = el;
 	sc->max_networks = max_networks;
-	sc->max_workers = max_workers;
+	sc->max_workers = num_workers;
+	sc->min_workers = num_workers;
 	sc->num_workers = 0;
 	sc->log = logger;
 
@@ -382,6 +982,44 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t
 	}
 
 #ifdef HAVE_PTHREAD_H
+	if (config) {
+		if (config->network_cpus &&
+		    (fr_schedule_cpus_parse(sc, &sc->network_cpus, config->network_cpus) < 0)) {
+		cpu_fail:
+			fr_log(sc->log, L_ERR, "%s", fr_strerror());
+			talloc_free(sc);
+			return NULL;
+		}
+
+		if (config->worker_cpus &&
+		    (fr_schedule_cpus_parse(sc, &sc->worker_cpus, config->worker_cpus) < 0)) goto cpu_fail;
+
+		sc->numa = config->numa;
+
+		if (config->min_workers && ((int) config->min_workers < num_workers)) {
+			sc->min_workers = config->min_workers;
+		}
+		if ((int) config->max_workers > num_workers) sc->max_workers = config->max_workers;
+
+		sc->scale_up = config->scale_up;
+		sc->scale_down = config->scale_down;
+		sc->interval = (config->scale_interval.tv_sec * NANOSEC) + (config->scale_interval.tv_usec * 1000);
+	}
+
+	if (!sc->scale_up) sc->scale_up = 75;
+	if (!sc->interval) sc->interval = NANOSEC;
+
+#ifdef SCHEDULE_AFFINITY
+	if (sc->numa && (fr_schedule_numa_load(sc) == 0)) {
+		fr_log(sc->log, L_WARN, "Failed reading NUMA topology - threads will not be NUMA aware");
+		sc->numa = false;
+	}
+#else
+	if (sc->network_cpus.num || sc->worker_cpus.num || sc->numa) {
+		fr_log(sc->log, L_WARN, "Thread placement is not supported on this platform - ignoring");
+	}
+#endif
+
 	(void) pthread_attr_init(&attr);
 	(void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
@@ -397,58 +1035,61 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t
 		return NULL;
 	}
 
+	pthread_mutex_init(&sc->mutex, NULL);
+
 	/*
-	 *	Create the network thread first.
-	 *	@todo - create multiple network threads
+	 *	Create the network threads first.
 	 */
-	sc->sn = talloc_zero(sc, fr_schedule_network_t);
-	sc->sn->sc = sc;
-	sc->sn->id = 0;
-
-	rcode = pthread_create(&sc->sn->pthread_id, &attr, fr_schedule_network_thread, sc->sn);
-	if (rcode != 0) {
-		fr_strerror_printf("Failed creating network thread: %s", fr_syserror(errno));
-		goto fail;
-	}
-
-	SEM_WAIT_INTR(&sc->semaphore);
-	if (sc->sn->status != FR_CHILD_RUNNING) {
-	fail:
-		TALLOC_FREE(sc->sn);
-		fr_schedule_destroy(sc);
+	sc->sn = talloc_zero_array(sc, fr_schedule_network_t, sc->max_networks);
+	if (!sc->sn) {
+		fr_strerror_printf("Failed allocating memory");
+		sem_destroy(&sc->semaphore);
+		talloc_free(sc);
 		return NULL;
 	}
 
-	/*
-	 *	Create all of the workers.
-	 */
-	for (i = 0; i < sc->max_workers; i++) {
-		fr_schedule_worker_t *sw;
+	for (i = 0; i < sc->max_networks; i++) {
+		fr_schedule_network_t *sn = &sc->sn[i];
 
-		fr_log(sc->log, L_DBG, "Creating %d/%d workers\n", i, sc->max_workers);
+		sn->sc = sc;
+		sn->id = i;
+		fr_schedule_network_place(sc, sn);
 
-		/*
-		 *	Create a worker "glue" structure
-		 */
-		sw = talloc(NULL, fr_schedule_worker_t);
-		if (!sw) {
-			fr_log(sc->log, L_ERR, "Worker %d - Failed allocating memory", i);
-			break;
+		rcode = pthread_create(&sn->pthread_id, &attr, fr_schedule_network_thread, sn);
+		if (rcode != 0) {
+			fr_strerror_printf("Failed creating network thread: %s", fr_syserror(rcode));
+			goto fail;
 		}
 
-		sw->id = i;
-		sw->sc = sc;
-		sw->status = FR_CHILD_INITIALIZING;
-		fr_dlist_insert_head(&sc->workers, &sw->entry);
+		SEM_WAIT_INTR(&sc->semaphore);
+		if (sn->status != FR_CHILD_RUNNING) {
+		fail:
+			fr_log(sc->log, L_ERR, "Failed creating network %d: %s", i, fr_strerror());
+			fr_schedule_destroy(sc);
+			return NULL;
+		}
+	}
 
-		rcode = pthread_create(&sw->pthread_id, &attr, fr_schedule_worker_thread, sw);
-		if (rcode != 0) {
-			fr_log(sc->log, L_ERR, "Failed creating worker %d: %s\n", i, fr_syserror(errno));
-			talloc_free(sw);
-			break;
+	/*
+	 *	Idle workers take surplus messages from busy ones.  The
+	 *	group is parented by the scheduler, so it is freed only
+	 *	after all of the workers have exited.
+	 */
+	if (sc->max_workers > 1) {
+		sc->steal = fr_worker_steal_create(sc, sc->max_workers);
+		if (!sc->steal) {
+			fr_log(sc->log, L_WARN, "Failed creating steal group - workers will not share requests: %s",
+			       fr_strerror());
 		}
+	}
 
-		sc->num_workers++;
+	/*
+	 *	Create all of the workers.
+	 */
+	for (i = 0; i < num_workers; i++) {
+		fr_log(sc->log, L_DBG, "Creating %d/%d workers\n", i, num_workers);
+
+		if (!fr_schedule_worker_alloc(sc, i)) break;
 	}
 
 	/*
@@ -484,14 +1125,26 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t
 	/*
 	 *	Failed to start some workers, refuse to do anything!
 	 */
-	if (sc->num_workers < sc->max_workers) {
+	if (sc->num_workers < num_workers) {
 		fr_schedule_destroy(sc);
-		sc = NULL;
+		return NULL;
+	}
+
+	/*
+	 *	Not fatal.  We just won't add or retire workers.
+	 */
+	sc->checked = fr_time();
+	rcode = pthread_create(&sc->manager_id, NULL, fr_schedule_manager_thread, sc);
+	if (rcode != 0) {
+		fr_log(sc->log, L_WARN, "Failed creating manager thread - the number of workers is fixed: %s",
+		       fr_syserror(rcode));
+	} else {
+		sc->manager = true;
 	}
 #endif
 
-	if (sc) fr_log(sc->log, L_INFO, "Scheduler created successfully with %d networks and %d workers",
-		       sc->max_networks, sc->num_workers);
+	fr_log(sc->log, L_INFO, "Scheduler created successfully with %d networks and %d workers",
+	       sc->max_networks, sc->num_workers);
 
 	return sc;
 }
@@ -508,8 +1161,6 @@ int fr_schedule_destroy(fr_schedule_t *sc)
 	int i;
 	fr_schedule_worker_t *sw;
 
-	sc->running = false;
-
 #ifdef HAVE_PTHREAD_H
 	fr_dlist_t	*entry, *next;
 
@@ -519,15 +1170,25 @@ int fr_schedule_destroy(fr_schedule_t *sc)
 	 *	Single threaded mode: kill the only network / worker we have.
 	 */
 	if (sc->el) {
+		sc->running = false;
 		fr_worker_destroy(sc->single_worker);
 		fr_network_destroy(sc->single_network);
 		goto done;
 	}
 
-	rad_assert(sc->num_workers > 0);
+	/*
+	 *	Stop adding and retiring workers.
+	 */
+	pthread_mutex_lock(&sc->mutex);
+	sc->running = false;
+	pthread_mutex_unlock(&sc->mutex);
+
+	if (sc->manager) (void) pthread_join(sc->manager_id, NULL);
 
 	/*
-	 *	Signal all of the workers to exit.
+	 *	Signal all of the workers to exit.  A retiring worker
+	 *	exits by itself, once the networks have closed their
+	 *	channels to it.
 	 */
 	for (entry = FR_DLIST_FIRST(sc->workers);
 	     entry != NULL;
@@ -535,6 +1196,8 @@ int fr_schedule_destroy(fr_schedule_t *sc)
 		next = FR_DLIST_NEXT(sc->workers, entry);
 
 		sw = fr_ptr_to_type(fr_schedule_worker_t, entry, entry);
+		if (sw->retiring) continue;
+
 		fr_worker_exit(sw->worker);
 	}
 
@@ -563,14 +1226,17 @@ int fr_schedule_destroy(fr_schedule_t *sc)
 	}
 
 	/*
-	 *	If the network thread is running, tell it to exit.
+	 *	If the network threads are running, tell them to exit.
 	 */
-	if (sc->sn->status == FR_CHILD_RUNNING) {
-		fr_network_exit(sc->sn->rc);
+	for (i = 0; i < sc->max_networks; i++) {
+		if (sc->sn[i].status != FR_CHILD_RUNNING) continue;
+
+		fr_network_exit(sc->sn[i].rc);
 		SEM_WAIT_INTR(&sc->semaphore);
 	}
 
 	sem_destroy(&sc->semaphore);
+	pthread_mutex_destroy(&sc->mutex);
 #endif	/* HAVE_PTHREAD_H */
 
 
@@ -586,7 +1252,26 @@ done:
 	return 0;
 }
 
+/** Return the number of network threads
+ *
+ *  Transports which can open multiple sockets for one address
+ *  (e.g. SO_REUSEPORT) should open one socket per network thread.
+ *
+ * @param[in] sc the scheduler
+ * @return the number of network threads.
+ */
+int fr_schedule_num_networks(fr_schedule_t const *sc)
+{
+	if (sc->el) return 1;
+
+	return sc->max_networks;
+}
+
 /** Add a socket to a scheduler.
+ *
+ *  Sockets are given to the network threads in turn, so that N
+ *  consecutive calls will add one socket to each of N network
+ *  threads.
  *
  * @param[in] sc the scheduler
  * @param[in] io the ctx and callbacks for the transport.
@@ -603,10 +1288,363 @@ fr_network_t *fr_schedule_socket_add(fr_schedule_t *sc, fr_listen_t const *io)
 	if (sc->el) {
 		nr = sc->single_network;
 	} else {
-		nr = sc->sn->rc;
+		nr = sc->sn[sc->next_network].rc;
+		sc->next_network = (sc->next_network + 1) % sc->max_networks;
 	}
 
 	if (fr_network_socket_add(nr, io) < 0) return NULL;
 
 	return nr;
 }
+
+/** Set the number of worker threads
+ *
+ *  Workers are added or retired one at a time by the manager
+ *  thread, so it may take a few seconds to reach the new number.
+ *
+ * @param[in] sc		the scheduler
+ * @param[in] num_workers	the number of workers, or 0 to add and
+ *				retire workers depending on how busy they are.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_schedule_workers_set(fr_schedule_t *sc, int num_workers)
+{
+	(void) talloc_get_type_abort(sc, fr_schedule_t);
+
+#ifdef HAVE_PTHREAD_H
+	if (sc->el || !sc->manager) {
+		fr_strerror_printf("The number of workers cannot be changed");
+		return -1;
+	}
+
+	if ((num_workers < 0) || (num_workers > sc->max_workers)) {
+		fr_strerror_printf("The number of workers must be between 1 and %d, or 0 for \"auto\"",
+				   sc->max_workers);
+		return -1;
+	}
+
+	pthread_mutex_lock(&sc->mutex);
+	sc->target = num_workers;
+	pthread_mutex_unlock(&sc->mutex);
+
+	return 0;
+#else
+	fr_strerror_printf("The number of workers cannot be changed");
+	return -1;
+#endif
+}
+
+/** Get the current state of the worker threads
+ *
+ * @param[in] sc	the scheduler
+ * @param[out] stats	where the state is written
+ */
+void fr_schedule_worker_stats(fr_schedule_t *sc, fr_schedule_worker_stats_t *stats)
+{
+	(void) talloc_get_type_abort(sc, fr_schedule_t);
+
+	if (sc->el) {
+		stats->num_workers = stats->min_workers = stats->max_workers = 1;
+		stats->target = 0;
+		stats->load = 0;
+		return;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&sc->mutex);
+#endif
+	stats->num_workers = sc->num_workers;
+	stats->target = sc->target;
+	stats->min_workers = sc->min_workers;
+	stats->max_workers = sc->max_workers;
+	stats->load = sc->load;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&sc->mutex);
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+typedef struct fr_schedule_stats_ctx_t fr_schedule_stats_ctx_t;
+
+/**
+ *  One thread's reply to a request for statistics.
+ */
+typedef struct fr_schedule_stats_entry_t {
+	fr_schedule_stats_ctx_t	*ctx;			//!< the request we're part of
+	int			id;			//!< of the network or worker
+	bool			is_worker;		//!< whether this is a worker or a network
+	atomic_bool		done;			//!< the thread has filled in the statistics
+
+	union {
+		fr_network_stats_t	network;
+		fr_worker_stats_t	worker;
+	} stats;
+} fr_schedule_stats_entry_t;
+
+/**
+ *  A request for statistics from all of the threads.
+ *
+ *  The requester may give up waiting before all of the threads have
+ *  replied.  So the request is reference counted, and is freed by
+ *  whoever is last to finish with it.
+ */
+struct fr_schedule_stats_ctx_t {
+	atomic_int		refs;			//!< the requester, plus each thread which hasn't replied
+	sem_t			semaphore;		//!< posted by each thread when it replies
+	int			num;			//!< number of entries
+	fr_schedule_stats_entry_t entry[];		//!< one for each thread
+};
+
+static void fr_schedule_stats_release(fr_schedule_stats_ctx_t *ctx)
+{
+	if (atomic_fetch_sub_explicit(&ctx->refs, 1, memory_order_acq_rel) != 1) return;
+
+	sem_destroy(&ctx->semaphore);
+	free(ctx);
+}
+
+/** Called by a network or worker thread when it has filled in its statistics
+ *
+ */
+static void _schedule_stats_done(void *uctx)
+{
+	fr_schedule_stats_entry_t *entry = uctx;
+	fr_schedule_stats_ctx_t *ctx = entry->ctx;
+
+	atomic_store_explicit(&entry->done, true, memory_order_release);
+	sem_post(&ctx->semaphore);
+
+	fr_schedule_stats_release(ctx);
+}
+
+/** Ask one thread for its statistics
+ *
+ */
+static void fr_schedule_stats_send(fr_schedule_stats_ctx_t *ctx, int *sent, int id, fr_network_t *nr, fr_worker_t *worker)
+{
+	int rcode;
+	fr_control_stats_t msg;
+	fr_schedule_stats_entry_t *entry = &ctx->entry[ctx->num];
+
+	entry->ctx = ctx;
+	entry->id = id;
+	entry->is_worker = (worker != NULL);
+	atomic_init(&entry->done, false);
+
+	msg.stats = &entry->stats;
+	msg.done = _schedule_stats_done;
+	msg.uctx = entry;
+
+	atomic_fetch_add_explicit(&ctx->refs, 1, memory_order_relaxed);
+
+	if (worker) {
+		rcode = fr_worker_stats_request(worker, &msg);
+	} else {
+		rcode = fr_network_stats_request(nr, &msg);
+	}
+
+	if (rcode < 0) {
+		atomic_fetch_sub_explicit(&ctx->refs, 1, memory_order_relaxed);
+		return;
+	}
+
+	ctx->num++;
+	(*sent)++;
+}
+#endif
+
+/** Get a snapshot of the statistics of all of the threads
+ *
+ *  Each network and worker thread is sent a control message, and
+ *  fills in its own statistics between events.  So the counters are
+ *  consistent, and the threads don't need to lock them.
+ *
+ *  Workers which are retiring are left out.
+ *
+ * @param[in] ctx	to allocate the snapshot in.
+ * @param[in] sc	the scheduler
+ * @return
+ *	- NULL on error
+ *	- the snapshot
+ */
+fr_schedule_thread_stats_t *fr_schedule_thread_stats(TALLOC_CTX *ctx, fr_schedule_t *sc)
+{
+	fr_schedule_thread_stats_t *out;
+
+	(void) talloc_get_type_abort(sc, fr_schedule_t);
+
+	out = talloc_zero(ctx, fr_schedule_thread_stats_t);
+	if (!out) {
+	oom:
+		fr_strerror_printf("Failed allocating memory");
+		return NULL;
+	}
+
+	/*
+	 *	Everything runs in this thread, so we can just look.
+	 */
+	if (sc->el) {
+		out->network_id = talloc_zero_array(out, int, 1);
+		out->network = talloc_zero_array(out, fr_network_stats_t, 1);
+		out->worker_id = talloc_zero_array(out, int, 1);
+		out->worker = talloc_zero_array(out, fr_worker_stats_t, 1);
+		if (!out->network_id || !out->network || !out->worker_id || !out->worker) {
+			talloc_free(out);
+			goto oom;
+		}
+
+		out->num_networks = out->num_workers = 1;
+		fr_network_stats(sc->single_network, &out->network[0]);
+		fr_worker_stats(sc->single_worker, &out->worker[0]);
+		return out;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	{
+		int			i, num, sent = 0, replied = 0, waited = 0;
+		fr_dlist_t		*entry;
+		fr_schedule_stats_ctx_t	*sctx;
+
+		pthread_mutex_lock(&sc->mutex);
+
+		num = sc->max_networks + sc->num_workers;
+		sctx = calloc(1, sizeof(*sctx) + (num * sizeof(sctx->entry[0])));
+		if (!sctx) {
+			pthread_mutex_unlock(&sc->mutex);
+			talloc_free(out);
+			goto oom;
+		}
+		atomic_init(&sctx->refs, 1);
+		if (sem_init(&sctx->semaphore, 0, SEMAPHORE_LOCKED) != 0) {
+			pthread_mutex_unlock(&sc->mutex);
+			free(sctx);
+			talloc_free(out);
+			fr_strerror_printf("Failed creating semaphore: %s", fr_syserror(errno));
+			return NULL;
+		}
+
+		/*
+		 *	Holding the mutex means that the manager can't
+		 *	retire a worker while we're sending to it.
+		 */
+		if (sc->running) {
+			for (i = 0; i < sc->max_networks; i++) {
+				if (sc->sn[i].status != FR_CHILD_RUNNING) continue;
+
+				fr_schedule_stats_send(sctx, &sent, sc->sn[i].id, sc->sn[i].rc, NULL);
+			}
+
+			for (entry = FR_DLIST_FIRST(sc->workers);
+			     entry != NULL;
+			     entry = FR_DLIST_NEXT(sc->workers, entry)) {
+				fr_schedule_worker_t *sw = fr_ptr_to_type(fr_schedule_worker_t, entry, entry);
+
+				if ((sw->status != FR_CHILD_RUNNING) || sw->retiring) continue;
+
+				fr_schedule_stats_send(sctx, &sent, sw->id, NULL, sw->worker);
+			}
+		}
+		pthread_mutex_unlock(&sc->mutex);
+
+		/*
+		 *	Wait for the replies, but not forever.  A
+		 *	worker may be stuck in a module.
+		 */
+		while ((replied < sent) && (waited < SCHEDULE_STATS_WAIT)) {
+			if (sem_trywait(&sctx->semaphore) == 0) {
+				replied++;
+				continue;
+			}
+
+			usleep(1000);
+			waited += 1000;
+		}
+
+		out->network_id = talloc_zero_array(out, int, sctx->num);
+		out->network = talloc_zero_array(out, fr_network_stats_t, sctx->num);
+		out->worker_id = talloc_zero_array(out, int, sctx->num);
+		out->worker = talloc_zero_array(out, fr_worker_stats_t, sctx->num);
+		if (!out->network_id || !out->network || !out->worker_id || !out->worker) {
+			fr_schedule_stats_release(sctx);
+			talloc_free(out);
+			goto oom;
+		}
+
+		for (i = 0; i < sctx->num; i++) {
+			fr_schedule_stats_entry_t *se = &sctx->entry[i];
+
+			if (!atomic_load_explicit(&se->done, memory_order_acquire)) {
+				out->num_missing++;
+				continue;
+			}
+
+			if (se->is_worker) {
+				out->worker_id[out->num_workers] = se->id;
+				out->worker[out->num_workers++] = se->stats.worker;
+			} else {
+				out->network_id[out->num_networks] = se->id;
+				out->network[out->num_networks++] = se->stats.network;
+			}
+		}
+
+		fr_schedule_stats_release(sctx);
+	}
+#endif
+
+	return out;
+}
+
+/** Merge the latency histograms of one worker, or of all of them
+ *
+ *  The histograms are read while the workers are running, so the
+ *  workers don't need to do anything.
+ *
+ * @param[in] sc	the scheduler
+ * @param[in] id	of the worker, or -1 for all workers.
+ * @param[out] out	the histogram to merge into.
+ * @param[in] type	the type of latency.
+ * @param[in] shadow	whether to merge the histograms of mirrored requests,
+ *			instead of production traffic.
+ * @return
+ *	- <0 if there's no such worker
+ *	- 0 on success
+ */
+int fr_schedule_latency_merge(fr_schedule_t *sc, int id, fr_time_histogram_t *out, fr_worker_latency_t type,
+			      bool shadow)
+{
+	int rcode = -1;
+
+	(void) talloc_get_type_abort(sc, fr_schedule_t);
+
+	if (sc->el) return fr_worker_latency_merge(sc->single_worker, out, type, 0, shadow);
+
+#ifdef HAVE_PTHREAD_H
+	{
+		fr_dlist_t *entry;
+
+		/*
+		 *	Holding the mutex means that the worker can't
+		 *	be freed while we're looking at it.
+		 */
+		pthread_mutex_lock(&sc->mutex);
+		for (entry = FR_DLIST_FIRST(sc->workers);
+		     entry != NULL;
+		     entry = FR_DLIST_NEXT(sc->workers, entry)) {
+			fr_schedule_worker_t *sw = fr_ptr_to_type(fr_schedule_worker_t, entry, entry);
+
+			if ((sw->status != FR_CHILD_RUNNING) || !sw->worker) continue;
+			if ((id >= 0) && (sw->id != id)) continue;
+
+			rcode = fr_worker_latency_merge(sw->worker, out, type, 0, shadow);
+			if ((rcode < 0) || (id >= 0)) break;
+		}
+		pthread_mutex_unlock(&sc->mutex);
+	}
+#endif
+
+	if ((rcode < 0) && (id >= 0)) fr_strerror_printf("No such worker %d", id);
+
+	return rcode;
+}
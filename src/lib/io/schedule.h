@@ -36,14 +36,72 @@ extern "C" {
 typedef struct fr_schedule_t fr_schedule_t;
 typedef int (*fr_schedule_thread_instantiate_t)(void *ctx, fr_event_list_t *el);
 
-fr_schedule_t		*fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t *log, int max_inputs, int max_workers,
+/** Placement of network and worker threads
+ *
+ *  CPU lists are in the usual Linux format, e.g. "0-3,8,10-11".
+ *  Thread N is pinned to the Nth CPU in the list, wrapping around
+ *  if there are more threads than CPUs.
+ *
+ *  Workers are added when they are busy more than scale_up percent
+ *  of the time, and retired when they are busy less than scale_down
+ *  percent of the time.
+ */
+typedef struct fr_schedule_config_t {
+	char const	*network_cpus;		//!< CPUs to pin the network threads to.
+	char const	*worker_cpus;		//!< CPUs to pin the worker threads to.
+	bool		numa;			//!< Keep workers on the same NUMA node as their network thread.
+	uint32_t	num_networks;		//!< Number of network threads.
+
+	uint32_t	num_workers;		//!< Number of worker threads to start with.
+	uint32_t	min_workers;		//!< Never retire workers below this number.
+	uint32_t	max_workers;		//!< Never add workers above this number.
+	uint32_t	scale_up;		//!< Add a worker when they're busier than this percentage.
+	uint32_t	scale_down;		//!< Retire a worker when they're less busy than this percentage.
+	struct timeval	scale_interval;		//!< How often we check how busy the workers are.
+} fr_schedule_config_t;
+
+/** The current state of the worker threads
+ */
+typedef struct fr_schedule_worker_stats_t {
+	int		num_workers;		//!< Number of worker threads, including retiring ones.
+	int		target;			//!< Number of workers set by the administrator, or 0 for "auto".
+	int		min_workers;		//!< Minimum number of workers.
+	int		max_workers;		//!< Maximum number of workers.
+	int		load;			//!< How busy the workers were in the last interval, in percent.
+} fr_schedule_worker_stats_t;
+
+/** A snapshot of the statistics of the network and worker threads
+ *
+ *  Threads which didn't reply in time are left out.
+ */
+typedef struct fr_schedule_thread_stats_t {
+	int			num_networks;		//!< number of entries in "network"
+	int			*network_id;		//!< ID of each network thread
+	fr_network_stats_t	*network;		//!< statistics for each network thread
+
+	int			num_workers;		//!< number of entries in "worker"
+	int			*worker_id;		//!< ID of each worker thread
+	fr_worker_stats_t	*worker;		//!< statistics for each worker thread
+
+	int			num_missing;		//!< number of threads which didn't reply
+} fr_schedule_thread_stats_t;
+
+fr_schedule_t		*fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t *log, int max_inputs, int num_workers,
 					    fr_schedule_thread_instantiate_t worker_thread_instantiate,
-					    void *worker_thread_ctx) CC_HINT(nonnull(3));
+					    void *worker_thread_ctx, fr_schedule_config_t const *config) CC_HINT(nonnull(3));
 /* schedulers are async, so there's no fr_schedule_run() */
 int			fr_schedule_destroy(fr_schedule_t *sc);
 
+int			fr_schedule_num_networks(fr_schedule_t const *sc) CC_HINT(nonnull);
+
 fr_network_t		*fr_schedule_socket_add(fr_schedule_t *sc, fr_listen_t const *io) CC_HINT(nonnull);
 
+int			fr_schedule_workers_set(fr_schedule_t *sc, int num_workers) CC_HINT(nonnull);
+void			fr_schedule_worker_stats(fr_schedule_t *sc, fr_schedule_worker_stats_t *stats) CC_HINT(nonnull);
+fr_schedule_thread_stats_t *fr_schedule_thread_stats(TALLOC_CTX *ctx, fr_schedule_t *sc) CC_HINT(nonnull(2));
+int			fr_schedule_latency_merge(fr_schedule_t *sc, int id, fr_time_histogram_t *out,
+						  fr_worker_latency_t type, bool shadow) CC_HINT(nonnull);
+
 #ifdef __cplusplus
 }
 #endif
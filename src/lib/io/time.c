@@ -25,8 +25,12 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/autoconf.h>
+#include <freeradius-devel/threads.h>
 #include <freeradius-devel/io/time.h>
 
+#include <string.h>
+#include <time.h>
+
 /*
  *	Avoid too many ifdef's later in the code.
  */
@@ -47,6 +51,37 @@ USES_APPLE_DEPRECATED_API
 #  include <mach/mach_time.h>
 #endif
 
+/*
+ *	On x86_64 we can read the time stamp counter directly, which
+ *	is much cheaper than clock_gettime().  We only do that if the
+ *	CPU says the TSC is invariant, i.e. it runs at a constant rate
+ *	regardless of power states.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && defined(HAVE_CLOCK_GETTIME)
+#  define HAVE_TSC
+#  include <cpuid.h>
+#  include <x86intrin.h>
+
+/*
+ *	The TSC is converted to nanoseconds with a fixed point
+ *	multiplier.  Each thread re-syncs its TSC base against
+ *	CLOCK_MONOTONIC about once a second, so that calibration
+ *	errors don't accumulate, and the product can't overflow.
+ */
+#  define TSC_SHIFT		(32)
+#  define TSC_CALIBRATE_NSEC	(10 * 1000 * 1000)
+
+static bool		tsc_enabled = false;	//!< Whether fr_time() uses the TSC.
+static uint64_t		tsc_mult;		//!< (nanoseconds << TSC_SHIFT) per TSC tick.
+static uint64_t		tsc_resync;		//!< TSC ticks between re-syncs, about one second.
+
+static _Thread_local uint64_t	tsc_base;	//!< TSC value when this thread last re-synced.
+static _Thread_local fr_time_t	tsc_base_time;	//!< fr_time_t when this thread last re-synced.
+static _Thread_local fr_time_t	tsc_last;	//!< Last time returned to this thread.
+#endif
+
+static _Thread_local fr_time_t	time_coarse;	//!< See fr_time_coarse().
+
 static struct timeval tm_started = { 0, 0};
 
 #ifdef HAVE_CLOCK_GETTIME
@@ -57,6 +92,65 @@ static mach_timebase_info_data_t timebase;
 static uint64_t abs_started;
 #endif
 
+static fr_time_t fr_time_monotonic(void);
+
+#ifdef HAVE_TSC
+/** Check whether the TSC can be used, and calibrate it against CLOCK_MONOTONIC
+ *
+ * @return
+ *	- true if fr_time() can use the TSC.
+ *	- false if it should use clock_gettime().
+ */
+static bool fr_time_tsc_calibrate(void)
+{
+	unsigned int	eax, ebx, ecx, edx;
+	struct timespec	delay = { 0, TSC_CALIBRATE_NSEC };
+	fr_time_t	start, end;
+	uint64_t	tsc_start, tsc_end;
+
+	/*
+	 *	Invariant TSC is CPUID.80000007H:EDX[8].
+	 */
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) return false;
+
+#ifdef __linux__
+	/*
+	 *	The kernel knows better than CPUID whether the TSC is
+	 *	synchronised across CPUs.  If it's stopped using the
+	 *	TSC as a clock source, so do we.
+	 */
+	{
+		FILE	*fp;
+		char	buffer[32];
+		bool	is_tsc = false;
+
+		fp = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+		if (fp) {
+			is_tsc = (fgets(buffer, sizeof(buffer), fp) != NULL) && (strncmp(buffer, "tsc", 3) == 0);
+			fclose(fp);
+			if (!is_tsc) return false;
+		}
+	}
+#endif
+
+	start = fr_time_monotonic();
+	tsc_start = __rdtsc();
+
+	(void) nanosleep(&delay, NULL);
+
+	end = fr_time_monotonic();
+	tsc_end = __rdtsc();
+
+	if ((tsc_end <= tsc_start) || (end <= start)) return false;
+
+	tsc_mult = ((end - start) << TSC_SHIFT) / (tsc_end - tsc_start);
+	tsc_resync = (tsc_end - tsc_start) * (NANOSEC / (end - start));
+	if (!tsc_mult || !tsc_resync) return false;
+
+	return true;
+}
+#endif
+
 /**  Initialize the local time.
  *
  *  MUST be called when the program starts.  MUST NOT be called after
@@ -73,7 +167,12 @@ int fr_time_start(void)
 	(void) gettimeofday(&tm_started, NULL);
 
 #ifdef HAVE_CLOCK_GETTIME
-	return clock_gettime(CLOCK_MONOTONIC, &ts_started);
+	if (clock_gettime(CLOCK_MONOTONIC, &ts_started) < 0) return -1;
+
+#  ifdef HAVE_TSC
+	tsc_enabled = fr_time_tsc_calibrate();
+#  endif
+	return 0;
 
 #else  /* __MACH__ is defined */
 	mach_timebase_info(&timebase);
@@ -84,14 +183,11 @@ int fr_time_start(void)
 }
 
 
-/** Return a relative time since the server ts_started.
- *
- *  This time is useful for doing time comparisons, deltas, etc.
- *  Human (i.e. printable) time is something else.
+/** Return the time since the server started, from the OS clock
  *
  * @returns fr_time_t time in nanoseconds since the server ts_started.
  */
-fr_time_t fr_time(void)
+static fr_time_t fr_time_monotonic(void)
 {
 #ifdef HAVE_CLOCK_GETTIME
 	fr_time_t now;
@@ -123,6 +219,77 @@ fr_time_t fr_time(void)
 #endif
 }
 
+/** Return a relative time since the server ts_started.
+ *
+ *  This time is useful for doing time comparisons, deltas, etc.
+ *  Human (i.e. printable) time is something else.
+ *
+ *  If the CPU has an invariant TSC, this reads the TSC instead of
+ *  calling clock_gettime().  The result never goes backwards for a
+ *  given thread.
+ *
+ * @returns fr_time_t time in nanoseconds since the server ts_started.
+ */
+fr_time_t fr_time(void)
+{
+#ifdef HAVE_TSC
+	if (likely(tsc_enabled)) {
+		uint64_t	tsc = __rdtsc();
+		uint64_t	delta = tsc - tsc_base;
+		fr_time_t	now;
+
+		/*
+		 *	First call in this thread, or it's time to
+		 *	re-sync.  This also catches the TSC going
+		 *	backwards, as delta wraps.
+		 */
+		if (unlikely(delta > tsc_resync)) {
+			now = fr_time_monotonic();
+			tsc_base = tsc;
+			tsc_base_time = now;
+		} else {
+			now = tsc_base_time + ((delta * tsc_mult) >> TSC_SHIFT);
+		}
+
+		if (unlikely(now < tsc_last)) return tsc_last;
+		tsc_last = now;
+
+		return now;
+	}
+#endif
+
+	return fr_time_monotonic();
+}
+
+/** Update the coarse time for this thread
+ *
+ *  Event loops call this once per pass, so that code which only
+ *  needs to know roughly what time it is (e.g. for timeouts) can
+ *  call fr_time_coarse() instead of fr_time().
+ *
+ * @returns the current time.
+ */
+fr_time_t fr_time_coarse_update(void)
+{
+	time_coarse = fr_time();
+
+	return time_coarse;
+}
+
+/** Return the time as of the last pass through this thread's event loop
+ *
+ *  If the thread doesn't update the coarse time, this is the same as
+ *  fr_time().
+ *
+ * @returns fr_time_t time in nanoseconds since the server ts_started.
+ */
+fr_time_t fr_time_coarse(void)
+{
+	if (unlikely(!time_coarse)) return fr_time();
+
+	return time_coarse;
+}
+
 /** Convert a fr_time_t to a struct timeval.
  *
  * @param[out] tv the timeval to update
@@ -228,7 +395,7 @@ void fr_time_tracking_resume(fr_time_tracking_t *tt, fr_time_t when)
 	tt->when = when;
 	tt->resumed = when;
 
-	rad_assert(tt->resumed <= tt->yielded);
+	rad_assert(tt->resumed >= tt->yielded);
 
 	tt->waiting += (tt->resumed - tt->yielded);
 
@@ -260,3 +427,180 @@ void fr_time_tracking_debug(fr_time_tracking_t *tt, FILE *fp)
 	DPRINT(running);
 	DPRINT(waiting);
 }
+
+/** Find the histogram bucket for a value
+ *
+ */
+static inline int fr_time_histogram_index(fr_time_t value)
+{
+	int msb;
+
+	if (value < FR_TIME_HISTOGRAM_SUB) return (int) value;
+
+#ifdef __GNUC__
+	msb = 63 - __builtin_clzll(value);
+#else
+	for (msb = FR_TIME_HISTOGRAM_SUB_BITS; (value >> (msb + 1)) != 0; msb++);
+#endif
+
+	if (msb > FR_TIME_HISTOGRAM_MAX_BITS) return FR_TIME_HISTOGRAM_BUCKETS - 1;
+
+	return ((msb - FR_TIME_HISTOGRAM_SUB_BITS + 1) << FR_TIME_HISTOGRAM_SUB_BITS) +
+		(int) ((value >> (msb - FR_TIME_HISTOGRAM_SUB_BITS)) & (FR_TIME_HISTOGRAM_SUB - 1));
+}
+
+/** Find the largest value which is counted in a histogram bucket
+ *
+ */
+static fr_time_t fr_time_histogram_value(int index)
+{
+	int shift;
+
+	if (index < FR_TIME_HISTOGRAM_SUB) return index;
+
+	shift = (index >> FR_TIME_HISTOGRAM_SUB_BITS) - 1;
+
+	return (((fr_time_t) (FR_TIME_HISTOGRAM_SUB + (index & (FR_TIME_HISTOGRAM_SUB - 1)) + 1)) << shift) - 1;
+}
+
+#define HLOAD(_x) atomic_load_explicit(&(_x), memory_order_relaxed)
+#define HSTORE(_x, _v) atomic_store_explicit(&(_x), _v, memory_order_relaxed)
+
+/** Add a value to a histogram
+ *
+ *  Only the thread which owns the histogram may call this function.
+ *  The counters are updated with plain loads and stores, which is
+ *  enough for readers in other threads to see sane values.
+ *
+ * @param[in] h the histogram
+ * @param[in] value to add
+ */
+void fr_time_histogram_add(fr_time_histogram_t *h, fr_time_t value)
+{
+	int index = fr_time_histogram_index(value);
+
+	HSTORE(h->bucket[index], HLOAD(h->bucket[index]) + 1);
+	HSTORE(h->total, HLOAD(h->total) + value);
+	if (value > HLOAD(h->max)) HSTORE(h->max, value);
+
+	/*
+	 *	Update the count last, so that readers see it lagging
+	 *	behind the buckets, and not the other way around.
+	 */
+	atomic_store_explicit(&h->count, HLOAD(h->count) + 1, memory_order_release);
+}
+
+/** Merge one histogram into another
+ *
+ *  The source histogram may be in use by another thread.  The output
+ *  histogram is owned by the caller, and should be zeroed before the
+ *  first merge.
+ *
+ * @param[out] out the histogram to merge into.
+ * @param[in] h the histogram to merge from.
+ */
+void fr_time_histogram_merge(fr_time_histogram_t *out, fr_time_histogram_t *h)
+{
+	int i;
+	fr_time_t max;
+
+	HSTORE(out->count, HLOAD(out->count) + atomic_load_explicit(&h->count, memory_order_acquire));
+	HSTORE(out->total, HLOAD(out->total) + HLOAD(h->total));
+
+	max = HLOAD(h->max);
+	if (max > HLOAD(out->max)) HSTORE(out->max, max);
+
+	for (i = 0; i < FR_TIME_HISTOGRAM_BUCKETS; i++) {
+		HSTORE(out->bucket[i], HLOAD(out->bucket[i]) + HLOAD(h->bucket[i]));
+	}
+}
+
+/** Find a percentile value in a histogram
+ *
+ * @param[in] h the histogram
+ * @param[in] percentile to find, e.g. 99.9
+ * @return
+ *	- 0 if the histogram is empty.
+ *	- the value at the given percentile, rounded up to the top of
+ *	  its bucket, and never more than the largest value added.
+ */
+fr_time_t fr_time_histogram_percentile(fr_time_histogram_t *h, double percentile)
+{
+	int i;
+	uint64_t total, wanted, seen;
+	fr_time_t value, max;
+
+	total = 0;
+	for (i = 0; i < FR_TIME_HISTOGRAM_BUCKETS; i++) total += HLOAD(h->bucket[i]);
+	if (!total) return 0;
+
+	if (percentile < 0) percentile = 0;
+	if (percentile > 100) percentile = 100;
+
+	wanted = (uint64_t) ((percentile * total) / 100.0 + 0.5);
+	if (wanted < 1) wanted = 1;
+	if (wanted > total) wanted = total;
+
+	seen = 0;
+	for (i = 0; i < FR_TIME_HISTOGRAM_BUCKETS; i++) {
+		seen += HLOAD(h->bucket[i]);
+		if (seen >= wanted) break;
+	}
+	if (i == FR_TIME_HISTOGRAM_BUCKETS) i--;
+
+	value = fr_time_histogram_value(i);
+	max = HLOAD(h->max);
+	if (value > max) value = max;
+
+	return value;
+}
+
+/** Count the values in a histogram which are no larger than a limit
+ *
+ *  Only buckets which are entirely at or below the limit are counted,
+ *  so the result may be a little low, but is never too high.  The last
+ *  bucket has no upper bound, and is only counted when the limit is
+ *  the largest possible time.
+ *
+ * @param[in] h the histogram
+ * @param[in] limit the largest value to count
+ * @return the number of values
+ */
+uint64_t fr_time_histogram_count_le(fr_time_histogram_t *h, fr_time_t limit)
+{
+	int i;
+	uint64_t seen = 0;
+
+	for (i = 0; i < FR_TIME_HISTOGRAM_BUCKETS; i++) {
+		if (i == (FR_TIME_HISTOGRAM_BUCKETS - 1)) {
+			if (limit != (fr_time_t) ~0) break;
+		} else if (fr_time_histogram_value(i) > limit) {
+			break;
+		}
+
+		seen += HLOAD(h->bucket[i]);
+	}
+
+	return seen;
+}
+
+/** Print a summary of a histogram
+ *
+ * @param[in] h the histogram
+ * @param[in] name to print for the histogram
+ * @param[in] fp the file where the debug output is printed.
+ */
+void fr_time_histogram_debug(fr_time_histogram_t *h, char const *name, FILE *fp)
+{
+	uint64_t count = atomic_load_explicit(&h->count, memory_order_acquire);
+
+	if (!count) {
+		fprintf(fp, "\t%s = empty\n", name);
+		return;
+	}
+
+	fprintf(fp, "\t%s = count %"PRIu64" mean %"PRIu64" p50 %"PRIu64" p99 %"PRIu64" p999 %"PRIu64" max %"PRIu64"\n",
+		name, count, (uint64_t) (HLOAD(h->total) / count),
+		fr_time_histogram_percentile(h, 50), fr_time_histogram_percentile(h, 99),
+		fr_time_histogram_percentile(h, 99.9), (uint64_t) HLOAD(h->max));
+}
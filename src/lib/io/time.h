@@ -34,6 +34,12 @@ RCSIDH(time_h, "$Id$")
 #include <stdio.h>
 #include <inttypes.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -80,6 +86,32 @@ typedef struct fr_time_tracking_t {
 #define NANOSEC (1000000000)
 #define USEC	(1000000)
 
+#define FR_TIME_HISTOGRAM_SUB_BITS	(4)
+#define FR_TIME_HISTOGRAM_SUB		(1 << FR_TIME_HISTOGRAM_SUB_BITS)
+#define FR_TIME_HISTOGRAM_MAX_BITS	(36)
+#define FR_TIME_HISTOGRAM_BUCKETS	((FR_TIME_HISTOGRAM_MAX_BITS - FR_TIME_HISTOGRAM_SUB_BITS + 2) << FR_TIME_HISTOGRAM_SUB_BITS)
+
+/**
+ *  A log-linear histogram of times, in nanoseconds.
+ *
+ *  Values below FR_TIME_HISTOGRAM_SUB each get their own bucket.
+ *  Above that, each power of two is split into FR_TIME_HISTOGRAM_SUB
+ *  linear buckets, so a value is only ever reported to within 1/16th
+ *  of its real value.  Anything larger than 2^36ns (~68s) goes into
+ *  the last bucket.
+ *
+ *  The memory used is fixed.  A histogram has only one writer, which
+ *  updates it without locks, or locked instructions.  Any other thread
+ *  can read or merge it at any time, and will see a recent (if not
+ *  quite current) set of counts.
+ */
+typedef struct fr_time_histogram_t {
+	atomic_ullong	count;			//!< number of values added
+	atomic_ullong	total;			//!< sum of all values added
+	atomic_ullong	max;			//!< largest value added
+	atomic_ullong	bucket[FR_TIME_HISTOGRAM_BUCKETS];
+} fr_time_histogram_t;
+
 /*
  *	Functions to manage a doubly linked list.
  */
@@ -119,9 +151,12 @@ static inline void fr_dlist_remove(fr_dlist_t *entry)
 #define FR_DLIST_FIRST(head) (head.next == &head) ? NULL : head.next
 #define FR_DLIST_NEXT(head, p_entry) (p_entry->next == &head) ? NULL : p_entry->next
 #define FR_DLIST_TAIL(head) (head.prev == &head) ? NULL : head.prev
+#define FR_DLIST_PREV(head, p_entry) (p_entry->prev == &head) ? NULL : p_entry->prev
 
 int fr_time_start(void);
 fr_time_t fr_time(void);
+fr_time_t fr_time_coarse(void);
+fr_time_t fr_time_coarse_update(void);
 void fr_time_to_timeval(struct timeval *tv, fr_time_t when) CC_HINT(nonnull);
 
 void fr_time_tracking_start(fr_time_tracking_t *tt, fr_time_t when) CC_HINT(nonnull);
@@ -130,6 +165,12 @@ void fr_time_tracking_yield(fr_time_tracking_t *tt, fr_time_t when, fr_time_trac
 void fr_time_tracking_resume(fr_time_tracking_t *tt, fr_time_t when) CC_HINT(nonnull);
 void fr_time_tracking_debug(fr_time_tracking_t *tt, FILE *fp) CC_HINT(nonnull);
 
+void fr_time_histogram_add(fr_time_histogram_t *h, fr_time_t value) CC_HINT(nonnull);
+void fr_time_histogram_merge(fr_time_histogram_t *out, fr_time_histogram_t *h) CC_HINT(nonnull);
+fr_time_t fr_time_histogram_percentile(fr_time_histogram_t *h, double percentile) CC_HINT(nonnull);
+uint64_t fr_time_histogram_count_le(fr_time_histogram_t *h, fr_time_t limit) CC_HINT(nonnull);
+void fr_time_histogram_debug(fr_time_histogram_t *h, char const *name, FILE *fp) CC_HINT(nonnull);
+
 /** Convert a pointer to a member into a pointer to the parent structure.
  *
  */
@@ -0,0 +1,553 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file io/trace.c
+ * @brief Sampled traces of where the time went for a request.
+ *
+ * The network thread decides which requests are traced, so that the
+ * decision costs nothing in the workers.  A traced request collects
+ * spans as it goes through the network thread, the channel, the worker
+ * queue, decoding, each unlang section, each module call, encoding and
+ * sending.  The timestamps are the same fr_time() values which the
+ * time tracking uses.
+ *
+ * Finished traces are queued for an exporter thread, which sends them
+ * in batches to an OpenTelemetry collector, as OTLP/HTTP with JSON
+ * encoding.  If the collector is slow or down, traces are dropped
+ * instead of being queued without limit.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <string.h>
+#include <time.h>
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/io/trace.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#define TRACE_BATCH		(256)		//!< Export when this many traces are queued.
+#define TRACE_QUEUE_MAX		(8192)		//!< Drop traces when this many are queued.
+#define TRACE_INTERVAL		(1)		//!< Otherwise export this often, in seconds.
+#define TRACE_TIMEOUT		(2)		//!< For talking to the collector, in seconds.
+
+static uint32_t		trace_rate;			//!< Trace 1 in this many requests.  0 for none.
+static _Thread_local uint32_t trace_count;		//!< Requests seen by this thread since the last trace.
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	trace_mutex = PTHREAD_MUTEX_INITIALIZER;	//!< Protects the queue.
+static pthread_cond_t	trace_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t	trace_thread;
+#endif
+
+static fr_dlist_t	trace_queue = { &trace_queue, &trace_queue };
+static int		trace_queued;
+static uint64_t		trace_dropped;
+static bool		trace_running;
+static bool		trace_stopping;
+
+static fr_ipaddr_t	trace_ipaddr;
+static uint16_t		trace_port;
+static char		*trace_host;			//!< For the Host header.
+static char		*trace_path;
+static char		*trace_service;
+static int64_t		trace_epoch;			//!< Add to fr_time() to get Unix time, in ns.
+
+/** Decide whether this request should be traced
+ *
+ * Called by the network thread for each packet it reads.
+ */
+bool fr_trace_sample(void)
+{
+	if (!trace_rate) return false;
+
+	if (++trace_count < trace_rate) return false;
+
+	trace_count = 0;
+	return true;
+}
+
+/** Start a trace
+ *
+ * @param[in] ctx	to allocate the trace in.  Usually NULL, as the
+ *			trace moves between threads.
+ * @param[in] name	of the root span, e.g. the listener.
+ * @param[in] start	when the packet was received.
+ * @return
+ *	- the trace.
+ *	- NULL on failure.
+ */
+fr_trace_t *fr_trace_alloc(TALLOC_CTX *ctx, char const *name, fr_time_t start)
+{
+	fr_trace_t	*trace;
+
+	trace = talloc_zero(ctx, fr_trace_t);
+	if (!trace) return NULL;
+
+	fr_rand_bytes(trace->trace_id, sizeof(trace->trace_id));
+	fr_rand_bytes(&trace->span_id, sizeof(trace->span_id));
+	trace->span_id &= ~((uint64_t) 0xff);	/* so span_id + index doesn't wrap */
+	if (!trace->span_id) trace->span_id = 0x100;
+
+	strlcpy(trace->span[0].name, name, sizeof(trace->span[0].name));
+	trace->span[0].parent = -1;
+	trace->span[0].start = start;
+	trace->num_spans = 1;
+	trace->current = 0;
+	trace->mark = start;
+
+	return trace;
+}
+
+/** Open a span, as a child of the innermost open span
+ *
+ * @param[in] trace	to add the span to.
+ * @param[in] name	of the span.
+ * @param[in] backend	which is being called, or NULL.
+ * @param[in] when	the span starts.
+ * @return
+ *	- the index of the span.
+ *	- -1 if the trace is full.
+ */
+int fr_trace_span_start(fr_trace_t *trace, char const *name, char const *backend, fr_time_t when)
+{
+	fr_trace_span_t *span;
+
+	if (trace->num_spans >= FR_TRACE_MAX_SPANS) {
+		trace->dropped++;
+		return -1;
+	}
+
+	span = &trace->span[trace->num_spans];
+	strlcpy(span->name, name, sizeof(span->name));
+	if (backend) strlcpy(span->backend, backend, sizeof(span->backend));
+	span->parent = trace->current;
+	span->start = when;
+
+	trace->current = trace->num_spans;
+
+	return trace->num_spans++;
+}
+
+/** Close a span
+ *
+ * @param[in] trace	the span is in.
+ * @param[in] span	from fr_trace_span_start().  Ignored if -1.
+ * @param[in] when	the span ended.
+ */
+void fr_trace_span_end(fr_trace_t *trace, int span, fr_time_t when)
+{
+	fr_trace_span_t *s;
+
+	if ((span < 0) || (span >= trace->num_spans)) return;
+
+	s = &trace->span[span];
+	if (s->yield_start) fr_trace_span_resume(trace, span, when);
+	s->end = (when > s->start) ? when : s->start;
+
+	/*
+	 *	Spans normally close in the reverse order they were
+	 *	opened.  If not, leave "current" alone.
+	 */
+	if (trace->current == span) trace->current = s->parent;
+	trace->mark = s->end;
+}
+
+/** Note that a span is waiting for something, e.g. a reply from a database
+ *
+ */
+void fr_trace_span_yield(fr_trace_t *trace, int span, fr_time_t when)
+{
+	if ((span < 0) || (span >= trace->num_spans)) return;
+
+	trace->span[span].yield_start = when;
+}
+
+/** Note that a span has stopped waiting
+ *
+ */
+void fr_trace_span_resume(fr_trace_t *trace, int span, fr_time_t when)
+{
+	fr_trace_span_t *s;
+
+	if ((span < 0) || (span >= trace->num_spans)) return;
+
+	s = &trace->span[span];
+	if (!s->yield_start) return;
+
+	if (when > s->yield_start) s->yielded += when - s->yield_start;
+	s->yield_start = 0;
+}
+
+/** Add a closed span, from when the last phase or span ended until now
+ *
+ * @param[in] trace	to add the span to.
+ * @param[in] name	of the phase, e.g. "decode".
+ * @param[in] when	the phase ended.
+ */
+void fr_trace_phase(fr_trace_t *trace, char const *name, fr_time_t when)
+{
+	int span;
+
+	span = fr_trace_span_start(trace, name, NULL, trace->mark);
+	fr_trace_span_end(trace, span, when);
+	trace->mark = when;
+}
+
+/** Record who the innermost open span is talking to
+ *
+ * e.g. the home server a request is proxied to.
+ */
+void fr_trace_peer(fr_trace_t *trace, char const *peer)
+{
+	if (trace->current < 0) return;
+
+	strlcpy(trace->span[trace->current].peer, peer, sizeof(trace->span[trace->current].peer));
+}
+
+/** Finish a trace, and queue it for export
+ *
+ * The caller must not use the trace after this.
+ *
+ * @param[in] trace	to finish.  It must have been allocated with a NULL ctx.
+ * @param[in] when	the request finished.
+ */
+void fr_trace_submit(fr_trace_t *trace, fr_time_t when)
+{
+	int i;
+
+	/*
+	 *	Close anything which is still open, e.g. a section
+	 *	which was stopped.
+	 */
+	for (i = trace->num_spans - 1; i >= 0; i--) {
+		if (!trace->span[i].end) fr_trace_span_end(trace, i, when);
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&trace_mutex);
+	if (!trace_running || (trace_queued >= TRACE_QUEUE_MAX)) {
+		trace_dropped++;
+		pthread_mutex_unlock(&trace_mutex);
+		talloc_free(trace);
+		return;
+	}
+
+	fr_dlist_insert_tail(&trace_queue, &trace->entry);
+	if (++trace_queued == TRACE_BATCH) pthread_cond_signal(&trace_cond);
+	pthread_mutex_unlock(&trace_mutex);
+#else
+	talloc_free(trace);
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+/** Append a JSON string, with quotes
+ *
+ */
+static char *trace_json_string(char *out, char const *in)
+{
+	char const	*p;
+
+	out = talloc_strdup_append_buffer(out, "\"");
+	for (p = in; out && *p; p++) {
+		if ((*p == '"') || (*p == '\\')) {
+			out = talloc_asprintf_append_buffer(out, "\\%c", *p);
+		} else if ((uint8_t) *p < 0x20) {
+			out = talloc_asprintf_append_buffer(out, "\\u%04x", (uint8_t) *p);
+		} else {
+			out = talloc_strndup_append_buffer(out, p, 1);
+		}
+	}
+	if (!out) return NULL;
+
+	return talloc_strdup_append_buffer(out, "\"");
+}
+
+/** Append a string attribute
+ *
+ */
+static char *trace_json_attr(char *out, bool *first, char const *key, char const *value)
+{
+	out = talloc_asprintf_append_buffer(out, "%s{\"key\":\"%s\",\"value\":{\"stringValue\":",
+					    *first ? "" : ",", key);
+	*first = false;
+	if (!out) return NULL;
+
+	out = trace_json_string(out, value);
+	if (!out) return NULL;
+
+	return talloc_strdup_append_buffer(out, "}}");
+}
+
+/** Append the spans of one trace
+ *
+ */
+static char *trace_json_spans(char *out, fr_trace_t *trace, bool *first_span)
+{
+	char	trace_id[(sizeof(trace->trace_id) * 2) + 1];
+	int	i;
+
+	fr_bin2hex(trace_id, trace->trace_id, sizeof(trace->trace_id));
+
+	for (i = 0; out && (i < trace->num_spans); i++) {
+		fr_trace_span_t	*s = &trace->span[i];
+		bool		first = true;
+
+		out = talloc_asprintf_append_buffer(out, "%s{\"traceId\":\"%s\",\"spanId\":\"%016" PRIx64 "\"",
+						    *first_span ? "" : ",", trace_id, trace->span_id + i);
+		*first_span = false;
+		if (!out) return NULL;
+
+		if (s->parent >= 0) {
+			out = talloc_asprintf_append_buffer(out, ",\"parentSpanId\":\"%016" PRIx64 "\"",
+							    trace->span_id + s->parent);
+			if (!out) return NULL;
+		}
+
+		/*
+		 *	Kind 2 is SERVER, 3 is CLIENT, and 1 is INTERNAL.
+		 */
+		out = talloc_strdup_append_buffer(out, ",\"name\":");
+		if (!out) return NULL;
+		out = trace_json_string(out, s->name);
+		if (!out) return NULL;
+
+		out = talloc_asprintf_append_buffer(out, ",\"kind\":%d,"
+						    "\"startTimeUnixNano\":\"%" PRId64 "\","
+						    "\"endTimeUnixNano\":\"%" PRId64 "\",\"attributes\":[",
+						    (i == 0) ? 2 : (s->backend[0] ? 3 : 1),
+						    (int64_t) s->start + trace_epoch, (int64_t) s->end + trace_epoch);
+		if (!out) return NULL;
+
+		if (s->backend[0]) out = trace_json_attr(out, &first, "freeradius.backend", s->backend);
+		if (out && s->peer[0]) out = trace_json_attr(out, &first, "peer.service", s->peer);
+		if (out && s->yielded) {
+			out = talloc_asprintf_append_buffer(out, "%s{\"key\":\"freeradius.yielded_ns\","
+							    "\"value\":{\"intValue\":\"%" PRIu64 "\"}}",
+							    first ? "" : ",", s->yielded);
+			first = false;
+		}
+		if (out && (i == 0) && trace->dropped) {
+			out = talloc_asprintf_append_buffer(out, "%s{\"key\":\"freeradius.dropped_spans\","
+							    "\"value\":{\"intValue\":\"%d\"}}",
+							    first ? "" : ",", trace->dropped);
+		}
+		if (!out) return NULL;
+
+		out = talloc_strdup_append_buffer(out, "]}");
+	}
+
+	return out;
+}
+
+/** Send a batch of traces to the collector
+ *
+ * @param[in] list	of traces, which are freed.
+ */
+static void trace_export(fr_dlist_t *list)
+{
+	fr_dlist_t	*entry;
+	char		*body, *header = NULL;
+	bool		first = true;
+	int		fd = -1;
+	struct timeval	tv = { TRACE_TIMEOUT, 0 };
+	struct iovec	iov[2];
+	char		buffer[256];
+	ssize_t		len;
+
+	body = talloc_strdup(NULL, "{\"resourceSpans\":[{\"resource\":{\"attributes\":[");
+	body = trace_json_attr(body, &first, "service.name", trace_service);
+	if (body) body = talloc_strdup_append_buffer(body, "]},\"scopeSpans\":[{\"scope\":{\"name\":\"freeradius\"},\"spans\":[");
+
+	first = true;
+	while ((entry = FR_DLIST_FIRST((*list))) != NULL) {
+		fr_trace_t *trace = fr_ptr_to_type(fr_trace_t, entry, entry);
+
+		fr_dlist_remove(entry);
+		if (body) body = trace_json_spans(body, trace, &first);
+		talloc_free(trace);
+	}
+
+	if (body) body = talloc_strdup_append_buffer(body, "]}]}]}");
+	if (!body) return;
+
+	header = talloc_asprintf(body, "POST %s HTTP/1.1\r\n"
+				 "Host: %s\r\n"
+				 "Content-Type: application/json\r\n"
+				 "Content-Length: %zu\r\n"
+				 "Connection: close\r\n"
+				 "\r\n", trace_path, trace_host, talloc_array_length(body) - 1);
+	if (!header) goto done;
+
+	fd = fr_socket_client_tcp(NULL, &trace_ipaddr, trace_port, false);
+	if (fd < 0) goto done;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = strlen(header);
+	iov[1].iov_base = body;
+	iov[1].iov_len = talloc_array_length(body) - 1;
+	if (fr_writev(fd, iov, 2, &tv) < 0) goto done;
+
+	/*
+	 *	We only care about the status, and only so there's
+	 *	something to see in a packet capture.  There's no one
+	 *	to tell if it failed.
+	 */
+	len = recv(fd, buffer, sizeof(buffer) - 1, 0);
+	if (len > 0) buffer[len] = '\0';
+
+done:
+	if (fd >= 0) close(fd);
+	talloc_free(body);
+}
+
+static void *trace_exporter(UNUSED void *arg)
+{
+	for (;;) {
+		fr_dlist_t	batch = { &batch, &batch };
+		fr_dlist_t	*entry;
+		struct timespec	when;
+		struct timeval	now;
+		bool		stopping;
+
+		gettimeofday(&now, NULL);
+		when.tv_sec = now.tv_sec + TRACE_INTERVAL;
+		when.tv_nsec = now.tv_usec * 1000;
+
+		pthread_mutex_lock(&trace_mutex);
+		if ((trace_queued < TRACE_BATCH) && !trace_stopping) {
+			(void) pthread_cond_timedwait(&trace_cond, &trace_mutex, &when);
+		}
+
+		/*
+		 *	Take the whole queue, so the workers aren't
+		 *	blocked while we talk to the collector.
+		 */
+		while ((entry = FR_DLIST_FIRST(trace_queue)) != NULL) {
+			fr_dlist_remove(entry);
+			fr_dlist_insert_tail(&batch, entry);
+		}
+		trace_queued = 0;
+		stopping = trace_stopping;
+		pthread_mutex_unlock(&trace_mutex);
+
+		if (FR_DLIST_FIRST(batch)) trace_export(&batch);
+
+		if (stopping) break;
+	}
+
+	return NULL;
+}
+#endif
+
+/** Start tracing requests, and exporting the traces
+ *
+ * Must be called after the server has forked, as the exporter thread
+ * doesn't survive fork(), and before the network threads are started.
+ *
+ * @param[in] endpoint	of the OTLP/HTTP collector, as "host:port" or "host:port/path".
+ *			The path defaults to "/v1/traces".
+ * @param[in] service	name to report the traces as coming from.
+ * @param[in] rate	trace one in this many requests.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_trace_start(char const *endpoint, char const *service, uint32_t rate)
+{
+#ifdef HAVE_PTHREAD_H
+	char const	*path;
+	char		*host;
+	struct timespec	ts;
+
+	if (trace_running || !rate) return 0;
+
+	path = strchr(endpoint, '/');
+	host = path ? talloc_strndup(NULL, endpoint, path - endpoint) : talloc_strdup(NULL, endpoint);
+	if (!host) return -1;
+
+	if (fr_inet_pton_port(&trace_ipaddr, &trace_port, host, -1, AF_UNSPEC, true, false) < 0) {
+		fr_strerror_printf("Invalid trace endpoint \"%s\": %s", endpoint, fr_strerror());
+		talloc_free(host);
+		return -1;
+	}
+	if (!trace_port) {
+		fr_strerror_printf("Trace endpoint \"%s\" has no port", endpoint);
+		talloc_free(host);
+		return -1;
+	}
+
+	trace_host = host;
+	trace_path = talloc_strdup(NULL, path ? path : "/v1/traces");
+	trace_service = talloc_strdup(NULL, service);
+
+	/*
+	 *	fr_time() is monotonic, and OTLP wants Unix time.
+	 */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	trace_epoch = (((int64_t) ts.tv_sec) * NANOSEC) + ts.tv_nsec - (int64_t) fr_time();
+
+	trace_stopping = false;
+	if (pthread_create(&trace_thread, NULL, trace_exporter, NULL) != 0) {
+		fr_strerror_printf("Failed creating trace exporter thread: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	trace_running = true;
+	trace_rate = rate;
+
+	return 0;
+#else
+	fr_strerror_printf("Tracing requires threads");
+	return -1;
+#endif
+}
+
+/** Export any queued traces, and stop the exporter thread
+ *
+ * Traces submitted after this are freed.
+ */
+void fr_trace_stop(void)
+{
+#ifdef HAVE_PTHREAD_H
+	if (!trace_running) return;
+
+	trace_rate = 0;
+
+	pthread_mutex_lock(&trace_mutex);
+	trace_running = false;
+	trace_stopping = true;
+	pthread_cond_signal(&trace_cond);
+	pthread_mutex_unlock(&trace_mutex);
+
+	pthread_join(trace_thread, NULL);
+
+	TALLOC_FREE(trace_host);
+	TALLOC_FREE(trace_path);
+	TALLOC_FREE(trace_service);
+#endif
+}
@@ -0,0 +1,89 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_TRACE_H
+#define _FR_TRACE_H
+/**
+ * $Id$
+ *
+ * @file io/trace.h
+ * @brief Sampled traces of where the time went for a request.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSIDH(trace_h, "$Id$")
+
+#include <talloc.h>
+
+#include <freeradius-devel/io/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FR_TRACE_MAX_SPANS	(64)	//!< Spans after this are counted, and dropped.
+#define FR_TRACE_NAME_LEN	(48)	//!< Longer names are truncated.
+
+/**
+ *  One phase of processing a request, e.g. decoding it, or calling a module.
+ */
+typedef struct fr_trace_span_t {
+	char		name[FR_TRACE_NAME_LEN];	//!< e.g. "decode", or "module sql"
+	char		backend[FR_TRACE_NAME_LEN];	//!< what was called, e.g. "rlm_sql", or ""
+	char		peer[FR_TRACE_NAME_LEN];	//!< who was called, e.g. a home server, or ""
+	int		parent;			//!< index of the parent span, or -1 for the root
+	fr_time_t	start;
+	fr_time_t	end;			//!< 0 while the span is open
+	fr_time_t	yielded;		//!< total time the span spent yielded
+	fr_time_t	yield_start;		//!< when the span last yielded, or 0
+} fr_trace_span_t;
+
+/**
+ *  The spans for one request.
+ *
+ *  A trace is created by the network thread, and passed to the worker
+ *  in the channel message.  The worker passes it back with the reply.
+ *  Only one thread uses a trace at a time, so it has no locks.  Once
+ *  the reply has been sent, the trace is given to the exporter.
+ */
+typedef struct fr_trace_t {
+	fr_dlist_t	entry;			//!< in the export queue
+	uint8_t		trace_id[16];
+	uint64_t	span_id;		//!< of the root span.  Other spans are span_id + their index.
+	fr_time_t	mark;			//!< when the last phase or span ended
+	int		current;		//!< index of the innermost open span
+	int		num_spans;
+	int		dropped;		//!< spans which didn't fit
+	fr_trace_span_t	span[FR_TRACE_MAX_SPANS];
+} fr_trace_t;
+
+bool		fr_trace_sample(void);
+fr_trace_t	*fr_trace_alloc(TALLOC_CTX *ctx, char const *name, fr_time_t start) CC_HINT(nonnull(2));
+int		fr_trace_span_start(fr_trace_t *trace, char const *name, char const *backend, fr_time_t when) CC_HINT(nonnull(1,2));
+void		fr_trace_span_end(fr_trace_t *trace, int span, fr_time_t when) CC_HINT(nonnull);
+void		fr_trace_span_yield(fr_trace_t *trace, int span, fr_time_t when) CC_HINT(nonnull);
+void		fr_trace_span_resume(fr_trace_t *trace, int span, fr_time_t when) CC_HINT(nonnull);
+void		fr_trace_phase(fr_trace_t *trace, char const *name, fr_time_t when) CC_HINT(nonnull);
+void		fr_trace_peer(fr_trace_t *trace, char const *peer) CC_HINT(nonnull);
+void		fr_trace_submit(fr_trace_t *trace, fr_time_t when) CC_HINT(nonnull);
+
+int		fr_trace_start(char const *endpoint, char const *service, uint32_t rate) CC_HINT(nonnull);
+void		fr_trace_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FR_TRACE_H */
@@ -25,58 +25,183 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/io/track.h>
-#include <freeradius-devel/rbtree.h>
+#include <freeradius-devel/hash.h>
 #include <freeradius-devel/rad_assert.h>
 
+/*
+ *	Initial number of hash slots, and the number of entries
+ *	allocated at a time for unconnected sockets.
+ */
+#define FR_TRACKING_SLOTS	(1024)
+#define FR_TRACKING_CHUNK	(256)
+
+/**
+ *  A slot in the hash table.  The hash is kept next to the pointer,
+ *  so that probing doesn't touch the entries themselves.
+ */
+typedef struct fr_tracking_slot_t {
+	uint32_t		hash;		//!< of the entry
+	fr_tracking_entry_t	*entry;		//!< NULL for an empty slot
+} fr_tracking_slot_t;
+
 /**
  *  RADIUS-specific tracking table.
  *
- *  It's a fixed-size array of 256 entries, indexed by ID.
+ *  For connected sockets, it's a fixed-size array of 256 entries per
+ *  packet code, indexed by ID.
+ *
+ *  For unconnected sockets, it's an open-addressing hash table keyed
+ *  by code, ID, and the first "key_size" bytes of the src/dst
+ *  information.  The table uses linear probing, and deletes by
+ *  shifting later entries back, so there are no tombstones.  Entries
+ *  are allocated in chunks, and recycled through a free list, so the
+ *  hash table can be resized without moving them.
+ *
+ *  The Request Authenticator is NOT part of the key.  A new packet
+ *  with the same ID from the same source replaces the old one, and
+ *  the insert returns FR_TRACKING_DIFFERENT.
  *
  *  @todo add a "reply" heap / list, ordered by when we need to
  *  clean up the replies.  The heap should contain nothing more than
  *  the time and the ID of the packet which needs cleaning up.
- *
- *  @todo allow for Request Authenticator to be used as part of the
- *  identifier.  With provisions for which attribute is used, and a
- *  slab allocator, as we can now have more than 256 packets
- *  outstanding.
  */
 struct fr_tracking_t {
 	int			num_entries;	//!< number of used entries.
 
 	size_t			src_dst_size;	//!< size of per-packet src/dst information
+	size_t			key_size;	//!< how much of the src/dst information is the key
+	size_t			entry_size;	//!< entry plus src/dst, rounded up for alignment
 
-	rbtree_t		*tree;		//!< for unconnected sockets
+	uint32_t		num_slots;	//!< size of the hash table.  Always a power of 2.
+	fr_tracking_slot_t	*slots;		//!< for unconnected sockets
+	fr_tracking_entry_t	*free_list;	//!< entries which can be re-used
 
 	fr_tracking_entry_t	*codes[];
 };
 
 
-static int entry_cmp(void const *one, void const *two)
+static uint32_t entry_hash(fr_tracking_t const *ft, uint8_t const *packet, void const *src_dst)
 {
-	fr_tracking_entry_t const *a = one, *b = two;
+	return fr_hash_update(src_dst, ft->key_size, fr_hash(packet, 2));
+}
 
-	/*
-	 *	Check Code and Identifier.
-	 *
-	 *	But NOT the Request Authenticator.
-	 */
-	if (a->data[0] != b->data[0]) return a->data[0] - b->data[0];
-	if (a->data[1] != b->data[1]) return a->data[1] - b->data[1];
+/** Find the slot holding a packet
+ *
+ * @param[in] ft	the tracking table.
+ * @param[in] hash	of the packet.
+ * @param[in] packet	the RADIUS header.  Only Code and Identifier are used.
+ * @param[in] src_dst	the src/dst information for the packet.
+ * @return
+ *	- the slot, which has a NULL entry if the packet isn't in the table.
+ */
+static fr_tracking_slot_t *slot_find(fr_tracking_t const *ft, uint32_t hash, uint8_t const *packet, void const *src_dst)
+{
+	uint32_t i, mask = ft->num_slots - 1;
+
+	for (i = hash & mask; ft->slots[i].entry != NULL; i = (i + 1) & mask) {
+		fr_tracking_entry_t *entry = ft->slots[i].entry;
+
+		if (ft->slots[i].hash != hash) continue;
+
+		if ((entry->data[0] == packet[0]) && (entry->data[1] == packet[1]) &&
+		    (memcmp(entry->src_dst, src_dst, ft->key_size) == 0)) break;
+	}
+
+	return &ft->slots[i];
+}
+
+/** Double the size of the hash table
+ *
+ */
+static int slots_grow(fr_tracking_t *ft)
+{
+	uint32_t i, j, mask, num_slots;
+	fr_tracking_slot_t *slots;
+
+	num_slots = ft->num_slots * 2;
+	mask = num_slots - 1;
+
+	slots = talloc_zero_array(ft, fr_tracking_slot_t, num_slots);
+	if (!slots) return -1;
+
+	for (i = 0; i < ft->num_slots; i++) {
+		if (!ft->slots[i].entry) continue;
+
+		for (j = ft->slots[i].hash & mask; slots[j].entry != NULL; j = (j + 1) & mask) {
+			/* nothing */
+		}
+
+		slots[j] = ft->slots[i];
+	}
+
+	talloc_free(ft->slots);
+	ft->slots = slots;
+	ft->num_slots = num_slots;
+
+	return 0;
+}
+
+/** Remove a slot from the hash table
+ *
+ *  Later entries in the same probe sequence are shifted back, so
+ *  that lookups never have to skip over deleted slots.
+ */
+static void slot_delete(fr_tracking_t *ft, fr_tracking_slot_t *slot)
+{
+	uint32_t i, j, home, mask = ft->num_slots - 1;
+
+	i = j = slot - ft->slots;
+
+	for (;;) {
+		j = (j + 1) & mask;
+		if (!ft->slots[j].entry) break;
 
-	return memcmp(a->src_dst, b->src_dst, a->src_dst_size);
+		/*
+		 *	The entry at "j" can only move back to "i" if
+		 *	its home slot isn't between "i" and "j".
+		 */
+		home = ft->slots[j].hash & mask;
+		if (((j - home) & mask) < ((j - i) & mask)) continue;
+
+		ft->slots[i] = ft->slots[j];
+		i = j;
+	}
+
+	ft->slots[i].entry = NULL;
+	ft->slots[i].hash = 0;
 }
 
-/** Free one entry.
+/** Get an entry from the free list, allocating more if necessary
  *
- *  @todo - use a slab allocator.
  */
-static void entry_free(void *data)
+static fr_tracking_entry_t *entry_alloc(fr_tracking_t *ft)
 {
-	fr_tracking_entry_t *entry = data;
+	fr_tracking_entry_t *entry;
+
+	if (!ft->free_list) {
+		int i;
+		uint8_t *chunk;
+
+		chunk = talloc_zero_size(ft, ft->entry_size * FR_TRACKING_CHUNK);
+		if (!chunk) return NULL;
+
+		for (i = FR_TRACKING_CHUNK - 1; i >= 0; i--) {
+			entry = (fr_tracking_entry_t *) (chunk + (i * ft->entry_size));
+
+			entry->next_free = ft->free_list;
+			ft->free_list = entry;
+		}
+	}
 
-	talloc_free(entry);
+	entry = ft->free_list;
+	ft->free_list = entry->next_free;
+
+	memset(entry, 0, ft->entry_size);
+	entry->ft = ft;
+	entry->src_dst = ((uint8_t *) entry) + (ft->entry_size - ft->src_dst_size);
+	entry->src_dst_size = ft->src_dst_size;
+
+	return entry;
 }
 
 
@@ -88,6 +213,10 @@ static void entry_free(void *data)
  * @param[in] ctx			the talloc ctx.
  * @param[in] src_dst_size		size of src/dst information for a packet on this socket.
  *					Use 0 for connected sockets.
+ * @param[in] src_dst_key_size		how many of the leading bytes of the src/dst information
+ *					identify the source of a packet.  Any remaining bytes
+ *					(timestamps, etc.) are copied, but not compared.
+ *					Use 0 for all of it.
  * @param[in] allowed_packets		the array of packet codes which are tracked in this table.
  *					We use this so we don't have to allocate arrays of tracking
  *					entries for unused codes.
@@ -95,7 +224,7 @@ static void entry_free(void *data)
  *	- NULL on error
  *	- fr_tracking_t * on success
  */
-fr_tracking_t *fr_radius_tracking_create(TALLOC_CTX *ctx, size_t src_dst_size,
+fr_tracking_t *fr_radius_tracking_create(TALLOC_CTX *ctx, size_t src_dst_size, size_t src_dst_key_size,
 					 bool const allowed_packets[FR_MAX_PACKET_CODE])
 {
 	int i;
@@ -104,6 +233,8 @@ fr_tracking_t *fr_radius_tracking_create(TALLOC_CTX *ctx, size_t src_dst_size,
 
 	if (!ctx) return NULL;
 
+	if (src_dst_key_size > src_dst_size) return NULL;
+
 	/*
 	 *	Connected sockets need an array of codes.
 	 *	Unconnected ones do not.
@@ -124,7 +255,24 @@ fr_tracking_t *fr_radius_tracking_create(TALLOC_CTX *ctx, size_t src_dst_size,
 	 *	The socket is unconnected.  We need to track entries by src/dst ip/port.
 	 */
 	if (src_dst_size > 0) {
-		ft->tree = rbtree_create(ft, entry_cmp, entry_free, RBTREE_FLAG_NONE);
+		ft->key_size = src_dst_key_size ? src_dst_key_size : src_dst_size;
+
+		/*
+		 *	Ensure that structures are aligned.
+		 */
+		ft->entry_size = sizeof(fr_tracking_entry_t);
+		ft->entry_size += 15;
+		ft->entry_size &= ~(15);
+		ft->entry_size += src_dst_size + 15;
+		ft->entry_size &= ~(15);
+
+		ft->num_slots = FR_TRACKING_SLOTS;
+		ft->slots = talloc_zero_array(ft, fr_tracking_slot_t, ft->num_slots);
+		if (!ft->slots) {
+			talloc_free(ft);
+			return NULL;
+		}
+
 		return ft;
 	}
 
@@ -155,6 +303,8 @@ fr_tracking_t *fr_radius_tracking_create(TALLOC_CTX *ctx, size_t src_dst_size,
  */
 int fr_radius_tracking_entry_delete(fr_tracking_t *ft, fr_tracking_entry_t *entry)
 {
+	fr_tracking_slot_t *slot;
+
 	(void) talloc_get_type_abort(ft, fr_tracking_t);
 
 	if (entry->timestamp == 0) return -1;
@@ -178,9 +328,15 @@ int fr_radius_tracking_entry_delete(fr_tracking_t *ft, fr_tracking_entry_t *entr
 
 	/*
 	 *	We are tracking src/dst ip/port, we have to remove
-	 *	this entry from the tracking tree, and then free it.
+	 *	this entry from the hash table, and then put it back
+	 *	on the free list.
 	 */
-	rbtree_deletebydata(ft->tree, entry);
+	slot = slot_find(ft, entry->hash, entry->data, entry->src_dst);
+	rad_assert(slot->entry == entry);
+	slot_delete(ft, slot);
+
+	entry->next_free = ft->free_list;
+	ft->free_list = entry;
 
 	return 0;
 }
@@ -202,7 +358,6 @@ fr_tracking_status_t fr_radius_tracking_entry_insert(fr_tracking_entry_t **p_ent
 						     fr_tracking_t *ft, uint8_t *packet, fr_time_t timestamp,
 						     void *src_dst)
 {
-	bool			insert = false;
 	fr_tracking_entry_t	*entry;
 
 	(void) talloc_get_type_abort(ft, fr_tracking_t);
@@ -250,27 +405,21 @@ fr_tracking_status_t fr_radius_tracking_entry_insert(fr_tracking_entry_t **p_ent
 
 		if (entry->reply) {
 			talloc_const_free(entry->reply);
+			entry->reply = NULL;
 			entry->reply_len = 0;
 		}
 
 	} else {
-		fr_tracking_entry_t my_entry;
+		uint32_t		hash;
+		fr_tracking_slot_t	*slot;
 
 		/*
-		 *	Unconnected socket: we have to allocate the
-		 *	entry ourselves.
-		 *
-		 *	@todo - use a slab allocator
+		 *	Unconnected socket: look in the hash table.
 		 */
-		my_entry.src_dst = src_dst;
-		my_entry.src_dst_size = ft->src_dst_size;
-		memcpy(my_entry.data, packet, sizeof(my_entry.data));
+		hash = entry_hash(ft, packet, src_dst);
+		slot = slot_find(ft, hash, packet, src_dst);
 
-		/*
-		 *	See if we're adding a duplicate, or
-		 *	over-writing an existing one.
-		 */
-		entry = rbtree_finddata(ft->tree, &my_entry);
+		entry = slot->entry;
 		if (entry) {
 			/*
 			 *	Duplicate, tell the caller so.
@@ -287,41 +436,45 @@ fr_tracking_status_t fr_radius_tracking_entry_insert(fr_tracking_entry_t **p_ent
 
 			if (entry->reply) {
 				talloc_const_free(entry->reply);
+				entry->reply = NULL;
 				entry->reply_len = 0;
 			}
 
-		/*
-		 *	Don't change src_dst.  It MUST have
-		 *	the same data as the previous entry.
-		 */
-		} else {
-			size_t align;
-			uint8_t *p;
+			/*
+			 *	The key part of src_dst is the same.
+			 *	The rest (e.g. timestamps) belongs to
+			 *	the new packet.
+			 */
+			memcpy(entry->src_dst, src_dst, ft->src_dst_size);
 
+		} else {
 			/*
-			 *	Ensure that structures are aligned.
+			 *	Keep the load factor under 3/4.  Growing
+			 *	moves the slots, so look again.
 			 */
-			align = sizeof(fr_tracking_entry_t);
-			align += 15;
-			align &= ~(15);
+			if (((ft->num_entries + 1) * 4) > (int) (ft->num_slots * 3)) {
+				if (slots_grow(ft) < 0) return FR_TRACKING_ERROR;
+
+				slot = slot_find(ft, hash, packet, src_dst);
+			}
 
 			/*
 			 *	No existing entry, create a new one.
 			 */
-			entry = talloc_size(ft->tree, align + ft->src_dst_size);
+			entry = entry_alloc(ft);
 			if (!entry) return FR_TRACKING_ERROR;
 
-			memset(entry, 0, align + ft->src_dst_size);
-			entry->ft = ft;
 			entry->timestamp = timestamp;
-			insert = true;
+			entry->hash = hash;
+			memcpy(entry->src_dst, src_dst, ft->src_dst_size);
+			memcpy(&entry->data[0], packet, sizeof(entry->data));
 
-			/*
-			 *	Copy the src_dst information over to the entry.
-			 */
-			entry->src_dst = p = ((uint8_t *) entry) + align;
-			entry->src_dst_size = ft->src_dst_size;
-			memcpy(p, src_dst, entry->src_dst_size);
+			slot->hash = hash;
+			slot->entry = entry;
+
+			ft->num_entries++;
+			*p_entry = entry;
+			return FR_TRACKING_NEW;
 		}
 	}
 
@@ -331,8 +484,6 @@ fr_tracking_status_t fr_radius_tracking_entry_insert(fr_tracking_entry_t **p_ent
 	memcpy(&entry->data[0], packet, sizeof(entry->data));
 	*p_entry = entry;
 
-	if (insert) rbtree_insert(ft->tree, entry);
-
 	return FR_TRACKING_DIFFERENT;
 }
 
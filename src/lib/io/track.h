@@ -45,7 +45,10 @@ typedef struct fr_tracking_entry_t {
 	fr_tracking_t		*ft;		//!< for cleanup_delay
 	fr_event_timer_t const	*ev;		//!< for cleanup_delay
 
+	struct fr_tracking_entry_t *next_free;	//!< in the tracking table's free list
+
 	fr_time_t		timestamp;	//!< when the request was received
+	uint32_t		hash;		//!< of the code, ID, and src/dst key
 	void			*src_dst;	//!< information about src/dst IP/port
 	size_t			src_dst_size;	//!< size of the data in src_dst
 	uint8_t const		*reply;		//!< the response (if any);
@@ -64,7 +67,7 @@ typedef enum fr_tracking_status_t {
 	FR_TRACKING_DIFFERENT,
 } fr_tracking_status_t;
 
-fr_tracking_t			*fr_radius_tracking_create(TALLOC_CTX *ctx, size_t src_dst_size,
+fr_tracking_t			*fr_radius_tracking_create(TALLOC_CTX *ctx, size_t src_dst_size, size_t src_dst_key_size,
 							   bool const allowed_packets[FR_MAX_PACKET_CODE]);
 
 int				fr_radius_tracking_entry_delete(fr_tracking_t *ft,
@@ -57,6 +57,14 @@
  *  yeilded, it is placed onto the yielded list in the worker
  *  "tracking" data structure.
  *
+ *  When workers are part of a "steal" group, a worker with a large
+ *  backlog in its "to_decode" heap offers new messages to idle
+ *  workers via a lock-free "surplus" queue.  An idle worker takes
+ *  messages from that queue, and processes them as if they were its
+ *  own.  The channel is still owned by the original worker, so the
+ *  reply is passed back to it via the "stolen" queue, and it sends
+ *  the reply on the channel.
+ *
  * @copyright 2016 Alan DeKok <aland@freeradius.org>
  */
 RCSID("$Id$")
@@ -65,6 +73,48 @@ RCSID("$Id$")
 #include <freeradius-devel/io/channel.h>
 #include <freeradius-devel/io/message.h>
 #include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/atomic_queue.h>
+#include <freeradius-devel/io/memory.h>
+#include <freeradius-devel/io/trace.h>
+#include <freeradius-devel/probe.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#define PTHREAD_MUTEX_LOCK   pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+/*
+ *	Only offer messages to other workers when we have at least
+ *	this many in the "to_decode" heap.
+ */
+#define WORKER_STEAL_THRESHOLD	(8)
+
+/*
+ *	The maximum number of messages which other workers may have
+ *	stolen from us, and not yet replied to.  This also sizes the
+ *	"surplus" and "stolen" queues.
+ */
+#define WORKER_STEAL_MAX	(256)
+
+/**
+ *  Latency histograms for one packet type.
+ */
+typedef struct fr_worker_latency_set_t {
+	fr_time_histogram_t	histogram[FR_WORKER_LATENCY_MAX];
+} fr_worker_latency_set_t;
+
+typedef _Atomic(fr_worker_latency_set_t *) fr_worker_latency_ptr_t;
 
 /**
  *  Track things by priority and time.
@@ -74,6 +124,39 @@ typedef struct fr_worker_heap_t {
 	fr_heap_t	*heap;			//!< heap, ordered by priority
 } fr_worker_heap_t;
 
+/**
+ *  One worker in a steal group.
+ *
+ *  Everything here is accessed by multiple threads.
+ */
+typedef struct fr_worker_steal_slot_t {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;		//!< held while "active" changes, and while other
+						///< workers use kq / ident, or return replies.
+#endif
+	atomic_bool		active;		//!< the owner is running, and kq / ident are valid
+	atomic_bool		sleeping;	//!< the owner is idle, and is willing to steal
+	atomic_int		num_surplus;	//!< number of messages in aq_surplus
+	atomic_int		num_stolen;	//!< number of stolen messages not yet replied to
+
+	int			kq;		//!< the owners kq
+	uintptr_t		ident;		//!< identifier for "steal" events
+
+	fr_atomic_queue_t	*aq_surplus;	//!< messages which any worker in the group may process
+	fr_atomic_queue_t	*aq_stolen;	//!< replies which the owner has to send on its channels
+
+	fr_message_set_t	*ms_steal;	//!< left behind by a worker which has exited, as the
+						///< network may still be using the replies in it.
+} fr_worker_steal_slot_t;
+
+/**
+ *  A group of workers which share surplus messages.
+ */
+struct fr_worker_steal_t {
+	int			num_slots;	//!< number of workers in the group
+	fr_worker_steal_slot_t	*slot;		//!< array of workers
+};
+
 #ifndef NDEBUG
 static void fr_worker_verify(fr_worker_t *worker);
 #define WORKER_VERIFY fr_worker_verify(worker)
@@ -81,6 +164,38 @@ static void fr_worker_verify(fr_worker_t *worker);
 #define WORKER_VERIFY
 #endif
 
+/*
+ *	The worker learns how big the talloc pool for a REQUEST should
+ *	be, separately for each listener.
+ */
+#define WORKER_POOL_LISTENERS	(16)		//!< listeners tracked separately.  The rest share one entry.
+#define WORKER_POOL_BUCKET	(1024)		//!< granularity of the histogram of memory used
+#define WORKER_POOL_BUCKETS	(64)		//!< so pools are at most 64K
+#define WORKER_POOL_MIN		(2 * 1024)
+#define WORKER_POOL_SAMPLES	(256)		//!< requests between recalculating the size
+#define WORKER_POOL_PERCENTILE	(95)		//!< of requests which should fit in the pool
+#define WORKER_POOL_OVERHEAD	(104)		//!< roughly, a talloc chunk header plus padding
+
+/**
+ *  How much memory the requests from one listener use.
+ */
+typedef struct {
+	fr_listen_t const	*listen;	//!< the requests came from, or NULL for "all the others"
+	size_t			size;		//!< of the pool for the next request
+	uint32_t		samples;	//!< since "size" was last recalculated
+	uint32_t		used[WORKER_POOL_BUCKETS]; //!< histogram of memory used by requests
+} fr_worker_pool_size_t;
+
+/**
+ *  The expensive parts of a REQUEST, kept when it finishes.
+ */
+typedef struct {
+	TALLOC_CTX		*pool;		//!< for the REQUEST, and everything it allocates
+	size_t			pool_size;	//!< the size of "pool"
+	void			*stack;		//!< unlang stack, or NULL
+	TALLOC_CTX		*state_ctx;	//!< session-state context, or NULL
+} fr_worker_request_shell_t;
+
 /**
  *  A worker which takes packets from a master, and processes them.
  */
@@ -99,6 +214,12 @@ struct fr_worker_t {
 
 	fr_control_t		*control;	//!< the control plane
 
+	fr_ring_buffer_t	*rb;		//!< ring buffer for control messages sent to us
+						///< by threads other than the networks.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;		//!< for sending us those messages
+#endif
+
 	fr_event_list_t		*el;		//!< our event list
 
 	uint64_t		number;		//!< for requests
@@ -109,7 +230,13 @@ struct fr_worker_t {
 	int                     message_set_size; //!< default start number of messages
 	int                     ring_buffer_size; //!< default start size for the ring buffers
 
-	size_t			talloc_pool_size; //!< for each REQUEST
+	size_t			talloc_pool_size; //!< for each REQUEST, until we've learned better
+
+	fr_worker_request_shell_t *request_shell; //!< what's left of finished requests, reused for new ones
+	int			num_request_shells; //!< number of entries in request_shell
+
+	fr_worker_pool_size_t	pool_size[WORKER_POOL_LISTENERS]; //!< learned pool sizes, by listener
+	int			num_pool_overflows; //!< requests which needed more memory than their pool had
 
 	fr_time_t		checked_timeout; //!< when we last checked the tails of the queues
 
@@ -125,16 +252,43 @@ struct fr_worker_t {
 	int			num_decoded;	//!< number of messages which have been decoded
 	int			num_replies;	//!< number of messages which were replied to
 	int			num_timeouts;	//!< number of messages which timed out
+	int			num_expired;	//!< number of requests dropped because they were past their deadline
 
 	fr_time_tracking_t	tracking;	//!< how much time the worker has spent doing things.
 
+	fr_worker_latency_set_t	latency;	//!< latency histograms for all packet types
+	fr_worker_latency_ptr_t	latency_by_code[FR_MAX_PACKET_CODE]; //!< latency histograms by packet code,
+							///< allocated when we first see that code.
+	fr_worker_latency_set_t	shadow;		//!< latency histograms for mirrored requests, which
+							///< aren't counted in the ones above.
+	int			num_shadow;	//!< number of mirrored requests processed
+	fr_time_t		shadow_running;	//!< time spent running mirrored requests
+
 	bool			exiting;	//!< are we exiting?
+	atomic_bool		retiring;	//!< exit once all of our channels have closed
+	atomic_ullong		running;	//!< tracking.running, for other threads to read
+	atomic_int		open_channels;	//!< num_channels, for other threads to read
 
 	fr_channel_t		**channel;	//!< list of channels
+	bool			*closing;	//!< the network has closed this channel, and we're
+						///< waiting for the outstanding requests to finish.
+
+	fr_worker_steal_t	*steal;		//!< the steal group we're in, if any
+	fr_worker_steal_slot_t	*slot;		//!< our entry in the steal group
+	fr_message_set_t	*ms_steal;	//!< for replies to messages we've stolen
+	int			num_stolen;	//!< number of messages we've stolen from other workers
+
+	fr_memory_t		*memory;	//!< used by our message sets.  May be NULL.
+	size_t			memory_used;	//!< what we last counted in "memory"
 };
 
 static void fr_worker_post_event(fr_event_list_t *el, struct timeval *now, void *uctx);
 
+/*
+ *	Maximum number of request shells each worker keeps.
+ */
+#define WORKER_REQUEST_SHELL_MAX	(64)
+
 /*
  *	We need wrapper macros because we have multiple instances of
  *	the same code.
@@ -165,6 +319,217 @@ static void fr_worker_post_event(fr_event_list_t *el, struct timeval *now, void
        } while (0)
 
 
+/** Wake up a worker in the steal group
+ *
+ *  WARNING: This is called from another thread!
+ *
+ *  The caller MUST hold the slot's mutex, and have checked that the
+ *  slot is active.  Otherwise the owner may have exited, and its kq
+ *  closed or reused.
+ *
+ * @param[in] slot the worker to wake up
+ */
+static void fr_worker_steal_wake(fr_worker_steal_slot_t *slot)
+{
+	(void) fr_event_user_trigger(slot->kq, slot->ident);
+}
+
+/** Finish closing a channel
+ *
+ *  The message set for our replies is handed over to the channel,
+ *  which the network owns.  The network may still have replies from
+ *  the message set in its queues, and it frees the channel (and
+ *  therefore the message set) only once it's done with them.
+ *
+ * @param[in] worker the worker
+ * @param[in] i the index of the channel
+ */
+static void fr_worker_channel_close(fr_worker_t *worker, int i)
+{
+	fr_channel_t *ch = worker->channel[i];
+	fr_message_set_t *ms;
+
+	ms = fr_channel_worker_ctx_get(ch);
+	rad_assert(ms != NULL);
+	fr_message_set_gc(ms);
+	(void) talloc_steal(ch, ms);
+
+	(void) fr_channel_worker_ack_close(ch);
+
+	fr_log(worker->log, L_DBG, "\t%sclosed channel %p", worker->name, ch);
+
+	worker->channel[i] = NULL;
+	worker->closing[i] = false;
+	rad_assert(worker->num_channels > 0);
+	worker->num_channels--;
+}
+
+/** Close a channel if it's closing, and the last outstanding request is done
+ *
+ * @param[in] worker the worker
+ * @param[in] ch the channel we've just sent a reply on
+ */
+static void fr_worker_channel_close_check(fr_worker_t *worker, fr_channel_t *ch)
+{
+	int i;
+
+	if (fr_channel_active(ch) || (fr_channel_worker_num_outstanding(ch) > 0)) return;
+
+	for (i = 0; i < worker->max_channels; i++) {
+		if (worker->channel[i] != ch) continue;
+
+		if (worker->closing[i]) fr_worker_channel_close(worker, i);
+		return;
+	}
+}
+
+/** Offer a message to the other workers in the steal group
+ *
+ *  We only do this when we have a backlog, AND another worker is
+ *  idle.  Otherwise, the message stays in our heap, where it is
+ *  ordered by priority.
+ *
+ * @param[in] worker the worker
+ * @param[in] cd the message to offer
+ * @return
+ *	- true if the message was offered to another worker
+ *	- false if the caller should process it
+ */
+static bool fr_worker_surplus_push(fr_worker_t *worker, fr_channel_data_t *cd)
+{
+	int i, start;
+	fr_worker_steal_slot_t *peer = NULL;
+
+	if (!worker->steal) return false;
+
+	if (fr_heap_num_elements(worker->to_decode.heap) < WORKER_STEAL_THRESHOLD) return false;
+
+	/*
+	 *	Find an idle worker, starting from the one after us.
+	 *	Clearing "sleeping" ensures that only one worker is
+	 *	woken up for each time it goes to sleep.
+	 */
+	start = worker->slot - worker->steal->slot;
+	for (i = 1; i < worker->steal->num_slots; i++) {
+		fr_worker_steal_slot_t *slot;
+
+		slot = &worker->steal->slot[(start + i) % worker->steal->num_slots];
+		if (!atomic_load_explicit(&slot->active, memory_order_acquire)) continue;
+
+		if (atomic_exchange_explicit(&slot->sleeping, false, memory_order_acq_rel)) {
+			peer = slot;
+			break;
+		}
+	}
+	if (!peer) return false;
+
+	if (!fr_atomic_queue_push(worker->slot->aq_surplus, cd)) return false;
+	atomic_fetch_add_explicit(&worker->slot->num_surplus, 1, memory_order_release);
+
+	/*
+	 *	If the peer exited in the meantime, the message stays
+	 *	in the queue, for another worker, or for us to
+	 *	expire.
+	 */
+	PTHREAD_MUTEX_LOCK(&peer->mutex);
+	if (atomic_load_explicit(&peer->active, memory_order_acquire)) fr_worker_steal_wake(peer);
+	PTHREAD_MUTEX_UNLOCK(&peer->mutex);
+
+	return true;
+}
+
+/** Take a message from the steal group
+ *
+ *  Our own surplus messages are checked first.  We then check the
+ *  other workers, so long as they don't have too many outstanding
+ *  stolen messages.
+ *
+ * @param[in] worker the worker
+ * @param[out] p_owner the worker which owns the channel for the message, or NULL for "us".
+ * @return
+ *	- NULL on no message available
+ *	- fr_channel_data_t the message
+ */
+static fr_channel_data_t *fr_worker_surplus_pop(fr_worker_t *worker, fr_worker_steal_slot_t **p_owner)
+{
+	int i;
+	fr_channel_data_t *cd;
+
+	*p_owner = NULL;
+
+	if (!worker->steal) return NULL;
+
+	if ((atomic_load_explicit(&worker->slot->num_surplus, memory_order_acquire) > 0) &&
+	    fr_atomic_queue_pop(worker->slot->aq_surplus, (void **) &cd)) {
+		atomic_fetch_sub_explicit(&worker->slot->num_surplus, 1, memory_order_relaxed);
+		return cd;
+	}
+
+	/*
+	 *	We're going away, so we don't take on any more work.
+	 *	The other workers can still take our surplus.
+	 */
+	if (atomic_load_explicit(&worker->retiring, memory_order_relaxed)) return NULL;
+
+	for (i = 0; i < worker->steal->num_slots; i++) {
+		fr_worker_steal_slot_t *slot = &worker->steal->slot[i];
+
+		if (slot == worker->slot) continue;
+
+		if (!atomic_load_explicit(&slot->active, memory_order_acquire)) continue;
+
+		if (atomic_load_explicit(&slot->num_surplus, memory_order_acquire) <= 0) continue;
+
+		/*
+		 *	Reserve space in the owners "stolen" queue
+		 *	before taking the message, so that the reply
+		 *	can always be returned.
+		 */
+		if (atomic_fetch_add_explicit(&slot->num_stolen, 1, memory_order_acq_rel) >= WORKER_STEAL_MAX) {
+			atomic_fetch_sub_explicit(&slot->num_stolen, 1, memory_order_relaxed);
+			continue;
+		}
+
+		if (!fr_atomic_queue_pop(slot->aq_surplus, (void **) &cd)) {
+			atomic_fetch_sub_explicit(&slot->num_stolen, 1, memory_order_relaxed);
+			continue;
+		}
+		atomic_fetch_sub_explicit(&slot->num_surplus, 1, memory_order_relaxed);
+
+		fr_log(worker->log, L_DBG, "\t%sstole request from worker %d", worker->name, i);
+		worker->num_stolen++;
+		*p_owner = slot;
+		return cd;
+	}
+
+	return NULL;
+}
+
+/** Check if there are messages available in the steal group
+ *
+ * @param[in] worker the worker
+ * @return
+ *	- true if there are messages we could process
+ *	- false if there are none.
+ */
+static bool fr_worker_surplus_available(fr_worker_t *worker)
+{
+	int i;
+
+	if (!worker->steal) return false;
+
+	for (i = 0; i < worker->steal->num_slots; i++) {
+		fr_worker_steal_slot_t *slot = &worker->steal->slot[i];
+
+		if ((slot != worker->slot) &&
+		    !atomic_load_explicit(&slot->active, memory_order_acquire)) continue;
+
+		if (atomic_load_explicit(&slot->num_surplus, memory_order_acquire) > 0) return true;
+	}
+
+	return false;
+}
+
 /** Drain the input channel
  *
  * @param[in] worker the worker
@@ -185,6 +550,9 @@ static void fr_worker_drain_input(fr_worker_t *worker, fr_channel_t *ch, fr_chan
 		worker->num_requests++;
 		fr_log(worker->log, L_DBG, "\t%sreceived request %d", worker->name, worker->num_requests);
 		cd->channel.ch = ch;
+		if (cd->trace) fr_trace_phase(cd->trace, "channel.request", fr_time());
+		if (fr_worker_surplus_push(worker, cd)) continue;
+
 		WORKER_HEAP_INSERT(to_decode, cd, request.list);
 	} while ((cd = fr_channel_recv_request(ch)) != NULL);
 }
@@ -250,6 +618,7 @@ static void fr_worker_channel_callback(void *ctx, void const *data, size_t data_
 						   worker->ring_buffer_size);
 			rad_assert(ms != NULL);
 			fr_channel_worker_ctx_add(ch, ms);
+			fr_channel_worker_batch_set(ch, true);
 
 			worker->num_channels++;
 			ok = true;
@@ -271,23 +640,20 @@ static void fr_worker_channel_callback(void *ctx, void const *data, size_t data_
 			if (worker->channel[i] != ch) continue;
 
 			/*
-			 *	@todo check the status, and
-			 *	put the channel into a
-			 *	"closing" list if we can't
-			 *	close it right now.  Then,
-			 *	wake up after a time and try
-			 *	to close it again.
+			 *	Pull in everything the network sent
+			 *	before it closed the channel.  We
+			 *	can only ack the close once all of
+			 *	those requests have been replied to.
 			 */
-			(void) fr_channel_worker_ack_close(ch);
-
-			ms = fr_channel_worker_ctx_get(ch);
-			rad_assert(ms != NULL);
-			fr_message_set_gc(ms);
-			talloc_free(ms);
-
-			worker->channel[i] = NULL;
-			rad_assert(worker->num_channels > 0);
-			worker->num_channels--;
+			fr_worker_drain_input(worker, ch, NULL);
+
+			if (fr_channel_worker_num_outstanding(ch) > 0) {
+				fr_log(worker->log, L_DBG, "\t%sdeferring close of channel %p with %d outstanding requests",
+				       worker->name, ch, fr_channel_worker_num_outstanding(ch));
+				worker->closing[i] = true;
+			} else {
+				fr_worker_channel_close(worker, i);
+			}
 			ok = true;
 			break;
 		}
@@ -321,15 +687,159 @@ static void fr_worker_evfilt_user(UNUSED int kq, UNUSED struct kevent const *kev
 }
 
 
+/** Handle a worker control message callback for a statistics snapshot
+ *
+ * @param[in] ctx the worker
+ * @param[in] data the message
+ * @param[in] data_size size of the data
+ * @param[in] now the current time
+ */
+static void fr_worker_stats_callback(void *ctx, void const *data, size_t data_size, UNUSED fr_time_t now)
+{
+	fr_worker_t *worker = ctx;
+	fr_control_stats_t msg;
+
+	rad_assert(data_size == sizeof(msg));
+
+	memcpy(&msg, data, data_size);
+
+	fr_worker_stats(worker, msg.stats);
+	msg.done(msg.uctx);
+}
+
+
+/** Service a "steal" event.
+ *
+ *  Another worker has either returned a reply for a message it
+ *  stole from us, or it wants us to wake up and steal messages from
+ *  it.
+ *
+ * @param[in] kq the kq to service
+ * @param[in] kev the kevent to service
+ * @param[in] ctx the fr_worker_t
+ */
+static void fr_worker_steal_evfilt_user(UNUSED int kq, UNUSED struct kevent const *kev, void *ctx)
+{
+	int i;
+	fr_channel_t *ch;
+	fr_channel_data_t *reply, *cd;
+	fr_worker_t *worker = ctx;
+
+	talloc_get_type_abort(worker, fr_worker_t);
+
+	while (fr_atomic_queue_pop(worker->slot->aq_stolen, (void **) &reply)) {
+		atomic_fetch_sub_explicit(&worker->slot->num_stolen, 1, memory_order_relaxed);
+
+		ch = reply->channel.ch;
+
+		/*
+		 *	The channel may have been closed while the
+		 *	other worker was processing the request.
+		 */
+		for (i = 0; i < worker->max_channels; i++) {
+			if (worker->channel[i] == ch) break;
+		}
+		if (i == worker->max_channels) {
+			fr_log(worker->log, L_DBG, "\t%sdiscarding stolen reply for closed channel", worker->name);
+			TALLOC_FREE(reply->trace);
+			fr_message_done(&reply->m);
+			continue;
+		}
+
+		/*
+		 *	The network side uses this to decide which
+		 *	worker is least loaded.  So it has to be our
+		 *	CPU time, not the CPU time of the other worker.
+		 */
+		reply->reply.cpu_time = worker->tracking.running;
+
+		if (fr_channel_send_reply(ch, reply, &cd) < 0) {
+			fr_log(worker->log, L_DBG, "\t%sfails sending reply", worker->name);
+			cd = NULL;
+		}
+
+		if (cd) fr_worker_drain_input(worker, ch, cd);
+
+		fr_worker_channel_close_check(worker, ch);
+	}
+}
+
+
+/** Send a reply to the network thread
+ *
+ *  If another worker owns the channel, the reply is passed back to
+ *  it, and it sends the reply.
+ *
+ * @param[in] worker the worker
+ * @param[in] ch the channel for the reply
+ * @param[in] reply the reply to send
+ * @param[in] owner the worker which owns the channel, or NULL for "us"
+ */
+static void fr_worker_reply_send(fr_worker_t *worker, fr_channel_t *ch, fr_channel_data_t *reply,
+				 fr_worker_steal_slot_t *owner)
+{
+	fr_channel_data_t *cd;
+
+	worker->num_replies++;
+
+	if (owner) {
+		reply->channel.ch = ch;
+
+		/*
+		 *	The owner cleans up its "stolen" queue when it
+		 *	exits, with the mutex held.  So if it's still
+		 *	active here, it will see the reply.
+		 */
+		PTHREAD_MUTEX_LOCK(&owner->mutex);
+		if (!atomic_load_explicit(&owner->active, memory_order_acquire)) {
+			PTHREAD_MUTEX_UNLOCK(&owner->mutex);
+			fr_log(worker->log, L_DBG, "\t%sdiscarding stolen reply, the owner has exited", worker->name);
+			goto drop;
+		}
+
+		if (!fr_atomic_queue_push(owner->aq_stolen, reply)) {
+			PTHREAD_MUTEX_UNLOCK(&owner->mutex);
+			fr_log(worker->log, L_ERR, "\t%sfails returning stolen reply", worker->name);
+		drop:
+			atomic_fetch_sub_explicit(&owner->num_stolen, 1, memory_order_relaxed);
+			TALLOC_FREE(reply->trace);
+			fr_message_done(&reply->m);
+			return;
+		}
+
+		fr_worker_steal_wake(owner);
+		PTHREAD_MUTEX_UNLOCK(&owner->mutex);
+		return;
+	}
+
+	/*
+	 *	Send the reply, which also polls the request queue.
+	 */
+	if (fr_channel_send_reply(ch, reply, &cd) < 0) {
+		fr_log(worker->log, L_DBG, "\t%sfails sending reply", worker->name);
+		cd = NULL;
+	}
+
+	/*
+	 *	Drain the incoming TO_WORKER queue.  We do this every
+	 *	time we're done processing a request.
+	 */
+	if (cd) fr_worker_drain_input(worker, ch, cd);
+
+	fr_worker_channel_close_check(worker, ch);
+}
+
+
 /** Send a NAK to the network thread
  *
  *  The network thread believes that a worker is running a request until that request has been NAK'd.
  *
  * @param[in] worker the worker
  * @param[in] cd the message to NAK
+ * @param[in] owner the worker which owns the channel for the message, or NULL for "us"
  * @param[in] now when the message is NAKd
  */
-static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now)
+static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_worker_steal_slot_t *owner, fr_time_t now)
 {
 	size_t			size;
 	fr_channel_data_t	*reply;
@@ -345,7 +855,7 @@ static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t
 	ch = cd->channel.ch;
 	listen = cd->listen;
 
-	ms = fr_channel_worker_ctx_get(ch);
+	ms = owner ? worker->ms_steal : fr_channel_worker_ctx_get(ch);
 	rad_assert(ms != NULL);
 
 	/*
@@ -372,23 +882,284 @@ static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t
 
 	reply->listen = cd->listen;
 	reply->packet_ctx = cd->packet_ctx;
+	reply->trace = cd->trace;
 
 	/*
 	 *	Mark the original message as done.
 	 */
 	fr_message_done(&cd->m);
 
+	fr_worker_reply_send(worker, ch, reply, owner);
+}
+
+
+/** Find what we've learned about the memory used by requests from a listener
+ *
+ * @param[in] worker the worker
+ * @param[in] listen the requests came from.
+ * @return the entry for the listener.
+ */
+static fr_worker_pool_size_t *fr_worker_pool_size_find(fr_worker_t *worker, fr_listen_t const *listen)
+{
+	int i;
+
+	for (i = 0; i < (WORKER_POOL_LISTENERS - 1); i++) {
+		fr_worker_pool_size_t *ps = &worker->pool_size[i];
+
+		if (ps->listen == listen) return ps;
+
+		if (!ps->listen) {
+			ps->listen = listen;
+			return ps;
+		}
+	}
+
+	return &worker->pool_size[WORKER_POOL_LISTENERS - 1];
+}
+
+/** Learn how much memory a request used
+ *
+ *  Every WORKER_POOL_SAMPLES requests, the pool size for the listener
+ *  is set to the WORKER_POOL_PERCENTILE of what its requests used.
+ *  The older samples are then halved, so that the size follows
+ *  changes in the traffic.
+ *
+ *  talloc doesn't say how much of a pool was used, or whether
+ *  allocations overflowed it.  So we estimate it from the memory
+ *  the request still has, plus the overhead of each chunk.
+ *
+ * @param[in] worker the worker
+ * @param[in] request which has finished.
+ */
+static void fr_worker_pool_size_learn(fr_worker_t *worker, REQUEST *request)
+{
+	fr_worker_pool_size_t	*ps;
+	TALLOC_CTX		*pool = talloc_parent(request);
+	size_t			used;
+	uint32_t		total, want;
+	int			i;
+
+	used = talloc_total_size(pool) - talloc_get_size(pool);
+	used += (talloc_total_blocks(pool) - 1) * WORKER_POOL_OVERHEAD;
+
+	if (used > request->async->pool_size) worker->num_pool_overflows++;
+
+	ps = fr_worker_pool_size_find(worker, request->async->listen);
+
+	i = used / WORKER_POOL_BUCKET;
+	if (i >= WORKER_POOL_BUCKETS) i = WORKER_POOL_BUCKETS - 1;
+	ps->used[i]++;
+
+	if (++ps->samples < WORKER_POOL_SAMPLES) return;
+
+	total = 0;
+	for (i = 0; i < WORKER_POOL_BUCKETS; i++) total += ps->used[i];
+
+	want = ((total * WORKER_POOL_PERCENTILE) + 99) / 100;
+	total = 0;
+	for (i = 0; i < (WORKER_POOL_BUCKETS - 1); i++) {
+		total += ps->used[i];
+		if (total >= want) break;
+	}
+
+	ps->size = (i + 1) * WORKER_POOL_BUCKET;
+	if (ps->size < WORKER_POOL_MIN) ps->size = WORKER_POOL_MIN;
+
+	for (i = 0; i < WORKER_POOL_BUCKETS; i++) ps->used[i] /= 2;
+	ps->samples = 0;
+}
+
+/** Free a request shell
+ *
+ */
+static void fr_worker_request_shell_free(fr_worker_request_shell_t *shell)
+{
+	talloc_free(shell->pool);
+	talloc_free(shell->stack);
+	talloc_free(shell->state_ctx);
+}
+
+/** Get a shell to allocate a REQUEST in
+ *
+ *  The REQUEST, its packets, VALUE_PAIRs and their values are all
+ *  allocated from one talloc pool, so building a request costs
+ *  (usually) no calls to malloc().  The unlang stack and the
+ *  session-state context are kept, too.  The stack is most of the
+ *  memory of a REQUEST, and the session-state context would be a
+ *  separate malloc().
+ *
+ *  The most recently used shells are at the end of the array, so we
+ *  look there first.  Their memory is more likely to be in the CPU
+ *  cache.  We reuse a shell whose pool is big enough, but not much
+ *  bigger.  If there isn't one, the oldest shell is probably the
+ *  wrong size for the current traffic.  We keep its stack and
+ *  session-state context, and replace its pool.
+ *
+ * @param[in] worker the worker
+ * @param[in,out] shell "pool_size" is the size of pool we want.  The
+ *	rest is filled in.  "stack" and "state_ctx" may be NULL.
+ * @return
+ *	- 0 on success.
+ *	- -1 on allocation failure.
+ */
+static int fr_worker_request_shell_get(fr_worker_t *worker, fr_worker_request_shell_t *shell)
+{
+	size_t	size = shell->pool_size;
+	int	i;
+
+	for (i = worker->num_request_shells - 1; i >= 0; i--) {
+		if ((worker->request_shell[i].pool_size >= size) &&
+		    (worker->request_shell[i].pool_size <= (size * 2))) break;
+	}
+
+	if (i < 0) {
+		if (worker->num_request_shells == 0) {
+			shell->stack = NULL;
+			shell->state_ctx = NULL;
+			goto alloc;
+		}
+
+		i = 0;
+		TALLOC_FREE(worker->request_shell[0].pool);
+	}
+
+	*shell = worker->request_shell[i];
+
 	/*
-	 *	Send the reply, which also polls the request queue.
+	 *	Keep the most recently used shells at the end.
 	 */
-	if (fr_channel_send_reply(ch, reply, &cd) < 0) {
-		fr_log(worker->log, L_DBG, "\t%sfails sending reply", worker->name);
-		cd = NULL;
+	worker->num_request_shells--;
+	if (i < worker->num_request_shells) {
+		memmove(&worker->request_shell[i], &worker->request_shell[i + 1],
+			sizeof(worker->request_shell[0]) * (worker->num_request_shells - i));
 	}
 
-	worker->num_replies++;
+	if (shell->stack) (void) talloc_steal(NULL, shell->stack);
+	if (shell->state_ctx) (void) talloc_steal(NULL, shell->state_ctx);
 
-	if (cd) fr_worker_drain_input(worker, ch, cd);
+	if (shell->pool) {
+		(void) talloc_steal(NULL, shell->pool);
+		return 0;
+	}
+
+alloc:
+	shell->pool = talloc_pool(NULL, size);
+	if (!shell->pool) {
+		fr_worker_request_shell_free(shell);
+		return -1;
+	}
+	shell->pool_size = size;
+
+	talloc_set_name_const(shell->pool, "worker_request_pool");
+	return 0;
+}
+
+/** Free a REQUEST, and keep its shell for the next one
+ *
+ *  Freeing the children of the pool runs the destructors, but frees
+ *  no memory.  Once the last chunk has been freed, talloc resets the
+ *  pool, and the whole of it is available to the next request.
+ *
+ * @param[in] worker the worker
+ * @param[in] request allocated in a shell from fr_worker_request_shell_get().
+ */
+static void fr_worker_request_shell_put(fr_worker_t *worker, REQUEST *request)
+{
+	fr_worker_request_shell_t shell;
+
+	shell.pool = talloc_parent(request);
+	shell.pool_size = request->async->pool_size;
+	request_recycle(request, &shell.stack, &shell.state_ctx);
+
+	talloc_free_children(shell.pool);
+
+	if (worker->num_request_shells >= WORKER_REQUEST_SHELL_MAX) {
+		fr_worker_request_shell_free(&shell);
+		return;
+	}
+
+	/*
+	 *	Idle shells are parented by the worker, so that they
+	 *	are cleaned up when it goes away.
+	 */
+	(void) talloc_steal(worker, shell.pool);
+	if (shell.stack) (void) talloc_steal(worker, shell.stack);
+	if (shell.state_ctx) (void) talloc_steal(worker, shell.state_ctx);
+
+	worker->request_shell[worker->num_request_shells++] = shell;
+}
+
+/** Release the message a request was decoded from
+ *
+ *  The decoder may have pointed request->packet->data at the message
+ *  data.  If so, and the request still needs the data, we copy it to
+ *  the request before marking the message as done.  That only happens
+ *  for requests which yield, so the common case never copies the
+ *  packet data out of the message.
+ *
+ * @param[in] request the request
+ * @param[in] copy whether the request still needs the packet data.
+ */
+static void fr_worker_message_release(REQUEST *request, bool copy)
+{
+	fr_message_t *m = request->async->message;
+
+	if (!m) return;
+
+	request->async->message = NULL;
+
+	if (request->packet && request->packet->data &&
+	    (request->packet->data >= m->data) && (request->packet->data < (m->data + m->data_size))) {
+		if (copy) {
+			request->packet->data = talloc_memdup(request->packet, request->packet->data,
+							      request->packet->data_len);
+		} else {
+			request->packet->data = NULL;
+		}
+		if (!request->packet->data) request->packet->data_len = 0;
+	}
+
+	fr_message_done(m);
+}
+
+
+/** Record a latency figure for a request
+ *
+ *  The histograms for a packet code are allocated the first time we
+ *  see that code.  Other threads may be reading them, so the pointer
+ *  is only published once the histograms have been zeroed.
+ *
+ *  Mirrored requests have their own histograms, so they can be
+ *  compared with production traffic without skewing it.
+ *
+ * @param[in] worker the worker
+ * @param[in] request the latency is for
+ * @param[in] type the type of latency
+ * @param[in] value the time taken
+ */
+static void fr_worker_latency_add(fr_worker_t *worker, REQUEST *request, fr_worker_latency_t type, fr_time_t value)
+{
+	fr_worker_latency_set_t *set;
+	unsigned int code = request->packet->code;
+
+	if (request->async->listen->shadow) {
+		fr_time_histogram_add(&worker->shadow.histogram[type], value);
+		return;
+	}
+
+	fr_time_histogram_add(&worker->latency.histogram[type], value);
+
+	if (!code || (code >= FR_MAX_PACKET_CODE)) return;
+
+	set = atomic_load_explicit(&worker->latency_by_code[code], memory_order_relaxed);
+	if (!set) {
+		set = talloc_zero(worker, fr_worker_latency_set_t);
+		if (!set) return;
+
+		atomic_store_explicit(&worker->latency_by_code[code], set, memory_order_release);
+	}
+
+	fr_time_histogram_add(&set->histogram[type], value);
 }
 
 
@@ -405,6 +1176,9 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 	fr_channel_data_t *reply, *cd;
 	fr_channel_t *ch;
 	fr_message_set_t *ms;
+	fr_trace_t *trace = request->async->trace;
+
+	if (trace) fr_trace_span_end(trace, request->async->trace_span, fr_time());
 
 	/*
 	 *	Allocate and send the reply.
@@ -412,7 +1186,7 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 	ch = request->async->channel;
 	rad_assert(ch != NULL);
 
-	ms = fr_channel_worker_ctx_get(ch);
+	ms = request->async->stolen_from ? worker->ms_steal : fr_channel_worker_ctx_get(ch);
 	rad_assert(ms != NULL);
 
 	reply = (fr_channel_data_t *) fr_message_reserve(ms, size);
@@ -449,6 +1223,26 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 	 */
 	fr_time_tracking_end(&request->async->tracking, fr_time(), &worker->tracking);
 
+	fr_worker_latency_add(worker, request, FR_WORKER_LATENCY_RUNNING,
+			      request->async->tracking.running);
+	fr_worker_latency_add(worker, request, FR_WORKER_LATENCY_YIELDED,
+			      request->async->tracking.waiting);
+	fr_worker_latency_add(worker, request, FR_WORKER_LATENCY_TOTAL,
+			      (request->async->tracking.end > request->async->recv_time) ?
+			      request->async->tracking.end - request->async->recv_time : 0);
+
+	if (request->async->listen->shadow) {
+		worker->num_shadow++;
+		worker->shadow_running += request->async->tracking.running;
+	}
+
+	/*
+	 *	The encoder may need the original packet, so we only
+	 *	release the message once the reply has been encoded.
+	 *	The request is freed below, so there's no need to copy.
+	 */
+	fr_worker_message_release(request, false);
+
 	/*
 	 *	Fill in the rest of the fields in the channel message.
 	 *
@@ -462,30 +1256,98 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 	reply->listen = request->async->listen;
 	reply->packet_ctx = request->async->packet_ctx;
 
-	fr_log(worker->log, L_DBG, "(%"PRIu64") finished, sending reply", request->number);
-
 	/*
-	 *	Send the reply, which also polls the request queue.
+	 *	The trace goes back to the network thread, which
+	 *	finishes it once the reply has been written.
 	 */
-	if (fr_channel_send_reply(ch, reply, &cd) < 0) {
-		fr_log(worker->log, L_DBG, "\t%sfails sending reply", worker->name);
-		cd = NULL;
+	reply->trace = NULL;
+	if (trace) {
+		fr_trace_phase(trace, "encode", request->async->tracking.end);
+		reply->trace = talloc_steal(NULL, trace);
+		request->async->trace = NULL;
 	}
 
-	worker->num_replies++;
+	fr_log(worker->log, L_DBG, "(%"PRIu64") finished, sending reply", request->number);
 
-	/*
-	 *	Drain the incoming TO_WORKER queue.  We do this every
-	 *	time we're done processing a request.
-	 */
-	if (cd) fr_worker_drain_input(worker, ch, cd);
+	FR_PROBE3(worker_send_reply, request->number, reply->m.data_size, request->async->tracking.running);
+
+	fr_worker_reply_send(worker, ch, reply, request->async->stolen_from);
+
+	fr_dlist_remove(&request->async->time_order);
+	fr_worker_pool_size_learn(worker, request);
+	fr_worker_request_shell_put(worker, request);
+}
+
+/** Stop a request which has taken too long
+ *
+ *  The request MUST NOT be in the "runnable" heap.
+ *
+ * @param[in] worker the worker
+ * @param[in] request the request to stop
+ */
+static void fr_worker_stop_request(fr_worker_t *worker, REQUEST *request)
+{
+	fr_io_final_t final;
+
+	fr_dlist_remove(&request->async->time_order);
+
+	final = request->async->process(request, FR_IO_ACTION_DONE);
+
+	if (final != FR_IO_DONE) {
+		fr_dlist_insert_tail(&worker->waiting_to_die, &request->async->time_order);
+		return;
+	}
 
 	/*
-	 *	@todo Use a talloc pool for the request.  Clean it up,
-	 *	and insert it back into a slab allocator.
+	 *	Tell the network side that this request is done.
 	 */
-	fr_dlist_remove(&request->async->time_order);
-	talloc_free(request);
+	fr_worker_send_reply(worker, request, 0);
+}
+
+#define EXPIRED(_deadline, _now) ((_deadline) && ((_now) >= (_deadline)))
+
+/*
+ *	Requests with a deadline live until then.  Requests without
+ *	one live for a second.
+ */
+#define TOO_OLD(_deadline, _waiting, _now) ((_deadline) ? ((_now) >= (_deadline)) : ((_waiting) >= NANOSEC))
+
+/** Expire old messages in our surplus queue
+ *
+ *  The queue can't be searched, so we take every message in it, NAK
+ *  the ones which are too old, and put the rest back.
+ *
+ * @param[in] worker the worker
+ * @param[in] now the current time
+ */
+static void fr_worker_surplus_expire(fr_worker_t *worker, fr_time_t now)
+{
+	int i, num;
+	fr_channel_data_t *cd;
+
+	if (!worker->slot) return;
+
+	num = atomic_load_explicit(&worker->slot->num_surplus, memory_order_acquire);
+
+	for (i = 0; i < num; i++) {
+		fr_time_t waiting;
+
+		if (!fr_atomic_queue_pop(worker->slot->aq_surplus, (void **) &cd)) break;
+		atomic_fetch_sub_explicit(&worker->slot->num_surplus, 1, memory_order_relaxed);
+
+		waiting = (now > cd->m.when) ? now - cd->m.when : 0;
+		if (TOO_OLD(cd->request.deadline, waiting, now)) {
+			fr_worker_nak(worker, cd, NULL, now);
+			continue;
+		}
+
+		/*
+		 *	Only we push to our surplus queue, and we
+		 *	just made space in it.
+		 */
+		(void) fr_atomic_queue_push(worker->slot->aq_surplus, cd);
+		atomic_fetch_add_explicit(&worker->slot->num_surplus, 1, memory_order_release);
+	}
 }
 
 /** Check timeouts on the various queues
@@ -496,7 +1358,8 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
  *  "too long", and will need to be cleaned up.
  *
  * @param[in] worker the worker
- * @param[in] now the current time
+ * @param[in] now the current time.  This is the coarse time, so
+ *	messages stamped by the network thread may be newer than it.
  */
 static void fr_worker_check_timeouts(fr_worker_t *worker, fr_time_t now)
 {
@@ -513,15 +1376,15 @@ static void fr_worker_check_timeouts(fr_worker_t *worker, fr_time_t now)
 		fr_channel_data_t *cd;
 
 		cd = fr_ptr_to_type(fr_channel_data_t, request.list, entry);
-		waiting = now - cd->m.when;
+		waiting = (now > cd->m.when) ? now - cd->m.when : 0;
 
-		if (waiting < NANOSEC) break;
+		if (!TOO_OLD(cd->request.deadline, waiting, now)) break;
 
 		/*
 		 *	Waiting too long, delete it.
 		 */
 		WORKER_HEAP_EXTRACT(localized, cd, request.list);
-		fr_worker_nak(worker, cd, now);
+		fr_worker_nak(worker, cd, NULL, now);
 	}
 
 	/*
@@ -532,17 +1395,17 @@ static void fr_worker_check_timeouts(fr_worker_t *worker, fr_time_t now)
 		fr_channel_data_t *cd;
 
 		cd = fr_ptr_to_type(fr_channel_data_t, request.list, entry);
-		waiting = now - cd->m.when;
+		waiting = (now > cd->m.when) ? now - cd->m.when : 0;
 
-		if (waiting < (NANOSEC / 100)) break;
+		if ((waiting < (NANOSEC / 100)) && !EXPIRED(cd->request.deadline, now)) break;
 
 		/*
-		 *	Waiting too long, delete it.
+		 *	Waiting too long, or past its deadline, delete it.
 		 */
-		if (waiting > NANOSEC) {
+		if (TOO_OLD(cd->request.deadline, waiting, now)) {
 			WORKER_HEAP_EXTRACT(to_decode, cd, request.list);
 		nak:
-			fr_worker_nak(worker, cd, now);
+			fr_worker_nak(worker, cd, NULL, now);
 			continue;
 		}
 
@@ -550,45 +1413,38 @@ static void fr_worker_check_timeouts(fr_worker_t *worker, fr_time_t now)
 		 *	0.01 to 1s.  Localize it.
 		 */
 		WORKER_HEAP_EXTRACT(to_decode, cd, request.list);
-		lm = fr_message_localize(worker, &cd->m, sizeof(cd->m));
+		lm = fr_message_localize(worker, &cd->m, sizeof(*cd));
 		if (!lm) goto nak;
 
+		cd = (fr_channel_data_t *) lm;
 		WORKER_HEAP_INSERT(localized, cd, request.list);
 	}
 
+	/*
+	 *	Check the "surplus" queue for messages which no other
+	 *	worker has taken.
+	 */
+	fr_worker_surplus_expire(worker, now);
+
 	/*
 	 *	Check the "runnable" queue for old requests.
 	 */
 	while ((entry = FR_DLIST_TAIL(worker->time_order)) != NULL) {
 		REQUEST *request;
 		fr_async_t *async;
-		fr_io_final_t final;
 
 		async = fr_ptr_to_type(fr_async_t, time_order, entry);
 		request = talloc_parent(async);
-		waiting = now - request->async->recv_time;
-
-		if (waiting < NANOSEC) break;
+		waiting = (now > request->async->recv_time) ? now - request->async->recv_time : 0;
 
-		/*
-		 *	Waiting too long, delete it.
-		 */
-		fr_dlist_remove(&request->async->time_order);
-		(void) fr_heap_extract(worker->runnable, request);
-
-		final = request->async->process(request, FR_IO_ACTION_DONE);
-
-		if (final != FR_IO_DONE) {
-			fr_dlist_insert_tail(&worker->waiting_to_die, &request->async->time_order);
-			continue;
-		}
-
-		fr_log(worker->log, L_DBG, "(%"PRIu64") taking too long, stopping it", request->number);
+		if (!TOO_OLD(request->async->deadline, waiting, now)) break;
 
 		/*
-		 *	Tell the network side that this request is done.
+		 *	Waiting too long, delete it.
 		 */
-		fr_worker_send_reply(worker, request, 0);
+		fr_log(worker->log, L_DBG, "(%"PRIu64") taking too long, stopping it", request->number);
+		(void) fr_heap_extract(worker->runnable, request);
+		fr_worker_stop_request(worker, request);
 	}
 
 	/*
@@ -635,29 +1491,38 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 	REQUEST			*request;
 	fr_dlist_t		*entry;
 	fr_listen_t const	*listen;
-#ifndef HAVE_TALLOC_POOLED_OBJECT
-	TALLOC_CTX		*ctx;
-#endif
+	fr_worker_steal_slot_t	*owner = NULL;
+	fr_time_t		decode_start;
+	fr_worker_request_shell_t shell;
 
 	/*
-	 *	Grab a runnable request, and resume it.
+	 *	Grab a runnable request, and resume it.  If it's past
+	 *	its deadline, stop it instead of running it again.
 	 */
-	request = fr_heap_pop(worker->runnable);
-	if (request) {
+	while ((request = fr_heap_pop(worker->runnable)) != NULL) {
 		VERIFY_REQUEST(request);
 		fr_time_tracking_resume(&request->async->tracking, now);
-		return request;
+
+		if (!EXPIRED(request->async->deadline, now)) return request;
+
+		fr_log(worker->log, L_DBG, "(%"PRIu64") past its deadline, stopping it", request->number);
+		worker->num_expired++;
+		fr_worker_stop_request(worker, request);
 	}
 
 	/*
 	 *	Find either a localized message, or one which is in
-	 *	the "to_decode" queue.
+	 *	the "to_decode" queue.  If we have nothing to do, see
+	 *	if the other workers have surplus messages.
 	 */
 	do {
 		WORKER_HEAP_POP(localized, cd, request.list);
 		if (!cd) {
 			WORKER_HEAP_POP(to_decode, cd, request.list);
 		}
+		if (!cd) {
+			cd = fr_worker_surplus_pop(worker, &owner);
+		}
 		if (!cd) return NULL;
 
 		worker->num_decoded++;
@@ -669,13 +1534,31 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 		if (cd->request.recv_time && (cd->m.when != *cd->request.recv_time)) {
 			fr_log(worker->log, L_DBG, "\t%sIGNORING old message: was %zd now %zd", worker->name,
 				*cd->request.recv_time, cd->m.when);
-			fr_worker_nak(worker, cd, fr_time());
+			fr_worker_nak(worker, cd, owner, fr_time());
+			cd = NULL;
+			continue;
+		}
+
+		/*
+		 *	The client has given up on this request.
+		 *	Don't spend any time decoding or running it.
+		 */
+		if (EXPIRED(cd->request.deadline, now)) {
+			fr_log(worker->log, L_DBG, "\t%sIGNORING message past its deadline", worker->name);
+			worker->num_expired++;
+			fr_worker_nak(worker, cd, owner, now);
 			cd = NULL;
 		}
 	} while (!cd);
 
-	ctx = request = request_alloc(NULL);
-	if (!request) goto nak;
+	shell.pool_size = fr_worker_pool_size_find(worker, cd->listen)->size;
+	if (fr_worker_request_shell_get(worker, &shell) < 0) goto nak;
+
+	request = request_alloc_recycled(shell.pool, shell.stack, shell.state_ctx);
+	if (!request) {
+		fr_worker_request_shell_free(&shell);
+		goto nak;
+	}
 
 	request->el = worker->el;
 	request->backlog = worker->runnable;
@@ -703,13 +1586,18 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 	 *	processing this message.
 	 */
 	request->async->channel = cd->channel.ch;
+	request->async->stolen_from = owner;
 	request->async->original_recv_time = cd->request.recv_time;
 	request->async->recv_time = cd->m.when;
+	request->async->priority = cd->priority;
+	request->async->deadline = cd->request.deadline;
 	request->async->el = worker->el;
 	request->number = worker->number++;
 
 	request->async->listen = cd->listen;
 	request->async->packet_ctx = cd->packet_ctx;
+	request->async->message = &cd->m;
+	request->async->pool_size = shell.pool_size;
 	listen = request->async->listen;
 
 	/*
@@ -717,6 +1605,7 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 	 *
 	 *	Note that this also sets the "async process" function.
 	 */
+	decode_start = fr_time();
 	if (listen->app->decode) {
 		ret = listen->app->decode(listen->app_instance, request, cd->m.data, cd->m.data_size);
 	} else if (listen->app_io->decode) {
@@ -725,12 +1614,37 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 
 	if (ret < 0) {
 		fr_log(worker->log, L_DBG, "\t%sFAILED decode of request %"PRIu64, worker->name, request->number);
-		talloc_free(ctx);
+		fr_worker_request_shell_put(worker, request);
 nak:
-		fr_worker_nak(worker, cd, fr_time());
+		fr_worker_nak(worker, cd, owner, fr_time());
 		return NULL;
 	}
 
+	/*
+	 *	The message "when" time was set by the network thread,
+	 *	so it may be a little ahead of our clock.
+	 */
+	fr_worker_latency_add(worker, request, FR_WORKER_LATENCY_QUEUED,
+			      (decode_start > cd->m.when) ? decode_start - cd->m.when : 0);
+	fr_worker_latency_add(worker, request, FR_WORKER_LATENCY_DECODE, fr_time() - decode_start);
+
+	/*
+	 *	The request owns the trace until the reply is sent.
+	 *	Everything from here to encoding the reply is the
+	 *	"process" span, and the interpreter adds spans under
+	 *	it.
+	 */
+	if (cd->trace) {
+		fr_trace_t *trace = cd->trace;
+
+		fr_trace_phase(trace, "worker.queue", decode_start);
+		fr_trace_phase(trace, "decode", fr_time());
+
+		request->async->trace = talloc_steal(request, trace);
+		request->async->trace_span = fr_trace_span_start(trace, "process", NULL, trace->mark);
+		cd->trace = NULL;
+	}
+
 	/*
 	 *	Call the main protocol handlr to set the right async
 	 *	process function.
@@ -745,9 +1659,9 @@ nak:
 	if (!cd->request.recv_time) request->async->original_recv_time = &request->async->recv_time;
 
 	/*
-	 *	We're done with this message.
+	 *	We keep the message until the request is done, or it
+	 *	yields.  See fr_worker_message_release().
 	 */
-	fr_message_done(&cd->m);
 
 	/*
 	 *	New requests are inserted into the time order list in
@@ -821,6 +1735,8 @@ static void fr_worker_run_request(fr_worker_t *worker, REQUEST *request)
 
 	fr_log(worker->log, L_DBG, "\t%s running request (%"PRIu64")", worker->name, request->number);
 
+	FR_PROBE2(worker_request_start, request->number, request->async->recv_time);
+
 	/*
 	 *	If we still have the same packet, and the channel is
 	 *	active, run it.  Otherwise, tell it that it's done.
@@ -837,12 +1753,16 @@ static void fr_worker_run_request(fr_worker_t *worker, REQUEST *request)
 		 *	async cleanup queue.
 		 */
 		if (final != FR_IO_DONE) {
+			FR_PROBE2(worker_request_end, request->number, final);
+			fr_worker_message_release(request, true);
 			fr_dlist_remove(&request->async->time_order);
 			fr_dlist_insert_tail(&worker->waiting_to_die, &request->async->time_order);
 			return;
 		}
 	}
 
+	FR_PROBE2(worker_request_end, request->number, final);
+
 	/*
 	 *	Figure out what to do next.
 	 */
@@ -860,6 +1780,12 @@ static void fr_worker_run_request(fr_worker_t *worker, REQUEST *request)
 		break;
 
 	case FR_IO_YIELD:
+		/*
+		 *	Yielded requests may be around for a while,
+		 *	and would stop the network side from cleaning
+		 *	up its ring buffer.
+		 */
+		fr_worker_message_release(request, true);
 		fr_time_tracking_yield(&request->async->tracking, fr_time(), &worker->tracking);
 		return;
 
@@ -904,6 +1830,13 @@ static int fr_worker_pre_event(void *ctx, struct timeval *wake)
 	sleeping = (fr_heap_num_elements(worker->runnable) == 0);
 	if (sleeping) sleeping = (fr_heap_num_elements(worker->localized.heap) == 0);
 	if (sleeping) sleeping = (fr_heap_num_elements(worker->to_decode.heap) == 0);
+	if (sleeping) sleeping = !fr_worker_surplus_available(worker);
+
+	/*
+	 *	Let the other workers know whether or not we can take
+	 *	surplus messages from them.
+	 */
+	if (worker->slot) atomic_store_explicit(&worker->slot->sleeping, sleeping, memory_order_release);
 
 	/*
 	 *	Tell the event loop that there is new work to do.  We
@@ -936,6 +1869,12 @@ static int fr_worker_pre_event(void *ctx, struct timeval *wake)
 	return 0;
 }
 
+/*
+ *	Within a priority, requests are run earliest deadline first.
+ *	Requests without a deadline go after all those with one.
+ */
+#define DEADLINE(_x) ((_x) ? (_x) : ~(fr_time_t) 0)
+
 /**
  *  Track a channel in the "to_decode" or "localized" heap.
  */
@@ -947,6 +1886,10 @@ static int worker_message_cmp(void const *one, void const *two)
 	ret = (a->priority > b->priority) - (a->priority < b->priority);
 	if (ret != 0) return ret;
 
+	ret = (DEADLINE(a->request.deadline) > DEADLINE(b->request.deadline)) -
+	      (DEADLINE(a->request.deadline) < DEADLINE(b->request.deadline));
+	if (ret != 0) return ret;
+
 	return (a->m.when > b->m.when) - (a->m.when < b->m.when);
 }
 
@@ -961,6 +1904,10 @@ static int worker_request_cmp(void const *one, void const *two)
 	ret = (a->async->priority > b->async->priority) - (a->async->priority < b->async->priority);
 	if (ret != 0) return ret;
 
+	ret = (DEADLINE(a->async->deadline) > DEADLINE(b->async->deadline)) -
+	      (DEADLINE(a->async->deadline) < DEADLINE(b->async->deadline));
+	if (ret != 0) return ret;
+
 	return (a->async->recv_time > b->async->recv_time) - (a->async->recv_time < b->async->recv_time);
 }
 
@@ -993,6 +1940,46 @@ void fr_worker_destroy(fr_worker_t *worker)
 		fr_message_done(&cd->m);
 	}
 
+	/*
+	 *	Stop other workers from stealing from us, and clean up
+	 *	the messages they didn't take, and the replies they've
+	 *	returned.
+	 */
+	if (worker->slot) {
+		fr_channel_data_t *reply;
+
+		/*
+		 *	Once "active" is clear, no more replies are
+		 *	returned to us.  The ones already returned are
+		 *	for channels we're about to close, so they're
+		 *	marked done, as if we had sent them.
+		 */
+		PTHREAD_MUTEX_LOCK(&worker->slot->mutex);
+		atomic_store_explicit(&worker->slot->active, false, memory_order_release);
+		atomic_store_explicit(&worker->slot->sleeping, false, memory_order_release);
+
+		while (fr_atomic_queue_pop(worker->slot->aq_stolen, (void **) &reply)) {
+			atomic_fetch_sub_explicit(&worker->slot->num_stolen, 1, memory_order_relaxed);
+			TALLOC_FREE(reply->trace);
+			fr_message_done(&reply->m);
+		}
+		PTHREAD_MUTEX_UNLOCK(&worker->slot->mutex);
+
+		while (fr_atomic_queue_pop(worker->slot->aq_surplus, (void **) &cd)) {
+			fr_message_done(&cd->m);
+		}
+
+		(void) fr_event_user_delete(worker->el, fr_worker_steal_evfilt_user, worker);
+
+		/*
+		 *	Replies to stolen messages may still be in the
+		 *	channels of other workers.  The next worker to
+		 *	use this slot takes over the message set.
+		 */
+		worker->slot->ms_steal = talloc_steal(worker->steal, worker->ms_steal);
+		worker->ms_steal = NULL;
+	}
+
 	/*
 	 *	Signal the channels that we're closing.
 	 *
@@ -1005,7 +1992,7 @@ void fr_worker_destroy(fr_worker_t *worker)
 	for (i = 0; i < worker->max_channels; i++) {
 		if (!worker->channel[i]) continue;
 
-		fr_channel_worker_ack_close(worker->channel[i]);
+		fr_worker_channel_close(worker, i);
 	}
 
 	(void) fr_event_pre_delete(worker->el, fr_worker_pre_event, worker);
@@ -1027,7 +2014,7 @@ void fr_worker_destroy(fr_worker_t *worker)
  */
 fr_worker_t *fr_worker_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t const *logger, uint32_t flags)
 {
-	int max_channels = 64;
+	int i, max_channels = 64;
 	fr_worker_t *worker;
 
 	worker = talloc_zero(ctx, fr_worker_t);
@@ -1041,11 +2028,17 @@ nomem:
 	worker->flags = flags;
 
 	worker->channel = talloc_zero_array(worker, fr_channel_t *, max_channels);
-	if (!worker->channel) {
+	worker->closing = talloc_zero_array(worker, bool, max_channels);
+	worker->request_shell = talloc_zero_array(worker, fr_worker_request_shell_t, WORKER_REQUEST_SHELL_MAX);
+	if (!worker->channel || !worker->closing || !worker->request_shell) {
 		talloc_free(worker);
 		goto nomem;
 	}
 
+	atomic_init(&worker->retiring, false);
+	atomic_init(&worker->running, 0);
+	atomic_init(&worker->open_channels, 0);
+
 	worker->el = el;
 	worker->log = logger;
 
@@ -1053,10 +2046,17 @@ nomem:
 	 *	@todo make these configurable
 	 */
 	worker->max_channels = max_channels;
-	worker->talloc_pool_size = 4096; /* at least enough for a REQUEST */
+	worker->talloc_pool_size = 8 * 1024; /* a REQUEST, its packets and attributes */
+	for (i = 0; i < WORKER_POOL_LISTENERS; i++) worker->pool_size[i].size = worker->talloc_pool_size;
 	worker->message_set_size = 1024;
 	worker->ring_buffer_size = (1 << 16);
 
+	/*
+	 *	The worker works without memory accounting, so
+	 *	failing to allocate it isn't fatal.
+	 */
+	worker->memory = fr_memory_alloc(worker, "message_set", "worker");
+
 	if (fr_event_pre_insert(worker->el, fr_worker_pre_event, worker) < 0) {
 		fr_strerror_printf("Failed adding pre-check to event list");
 		talloc_free(worker);
@@ -1101,6 +2101,24 @@ nomem:
 		goto fail2;
 	}
 
+	if (fr_control_callback_add(worker->control, FR_CONTROL_ID_STATS, worker, fr_worker_stats_callback) < 0) {
+		fr_strerror_printf("Failed adding stats callback: %s", fr_strerror());
+		goto fail2;
+	}
+
+	worker->rb = fr_ring_buffer_create(worker, FR_CONTROL_MAX_MESSAGES * FR_CONTROL_MAX_SIZE);
+	if (!worker->rb) {
+		fr_strerror_printf("Failed creating ring buffer: %s", fr_strerror());
+		goto fail2;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&worker->mutex, NULL) != 0) {
+		fr_strerror_printf("Failed initializing mutex");
+		goto fail2;
+	}
+#endif
+
 	WORKER_HEAP_INIT(to_decode, worker_message_cmp, fr_channel_data_t, channel.heap_id);
 	WORKER_HEAP_INIT(localized, worker_message_cmp, fr_channel_data_t, channel.heap_id);
 
@@ -1121,6 +2139,139 @@ nomem:
 	return worker;
 }
 
+static int _fr_worker_steal_free(fr_worker_steal_t *steal)
+{
+#ifdef HAVE_PTHREAD_H
+	int i;
+
+	for (i = 0; i < steal->num_slots; i++) pthread_mutex_destroy(&steal->slot[i].mutex);
+#endif
+
+	return 0;
+}
+
+/** Create a steal group
+ *
+ *  The group is shared by all of the workers, and MUST be freed only
+ *  after all of them have exited.
+ *
+ * @param[in] ctx the talloc context
+ * @param[in] num_workers the maximum number of workers in the group
+ * @return
+ *	- NULL on error
+ *	- fr_worker_steal_t on success
+ */
+fr_worker_steal_t *fr_worker_steal_create(TALLOC_CTX *ctx, int num_workers)
+{
+	int i;
+	fr_worker_steal_t *steal;
+
+	steal = talloc_zero(ctx, fr_worker_steal_t);
+	if (!steal) {
+	nomem:
+		fr_strerror_printf("Failed allocating memory");
+		return NULL;
+	}
+
+	steal->slot = talloc_zero_array(steal, fr_worker_steal_slot_t, num_workers);
+	if (!steal->slot) {
+	fail:
+		talloc_free(steal);
+		goto nomem;
+	}
+	talloc_set_destructor(steal, _fr_worker_steal_free);
+
+	/*
+	 *	num_slots counts the mutexes which have been
+	 *	initialised, so the destructor only destroys those.
+	 */
+	for (i = 0; i < num_workers; i++) {
+		fr_worker_steal_slot_t *slot = &steal->slot[i];
+
+#ifdef HAVE_PTHREAD_H
+		if (pthread_mutex_init(&slot->mutex, NULL) != 0) goto fail;
+#endif
+		steal->num_slots++;
+
+		atomic_init(&slot->active, false);
+		atomic_init(&slot->sleeping, false);
+		atomic_init(&slot->num_surplus, 0);
+		atomic_init(&slot->num_stolen, 0);
+
+		slot->aq_surplus = fr_atomic_queue_create(steal->slot, WORKER_STEAL_MAX);
+		if (!slot->aq_surplus) goto fail;
+
+		slot->aq_stolen = fr_atomic_queue_create(steal->slot, WORKER_STEAL_MAX);
+		if (!slot->aq_stolen) goto fail;
+	}
+
+	return steal;
+}
+
+/** Add a worker to a steal group
+ *
+ *  MUST be called from the worker thread, before fr_worker() is run.
+ *
+ * @param[in] worker the worker
+ * @param[in] steal the steal group
+ * @param[in] id the workers entry in the group
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_worker_steal_join(fr_worker_t *worker, fr_worker_steal_t *steal, int id)
+{
+	fr_worker_steal_slot_t *slot;
+
+	WORKER_VERIFY;
+
+	if ((id < 0) || (id >= steal->num_slots)) {
+		fr_strerror_printf("Invalid worker ID %d", id);
+		return -1;
+	}
+	slot = &steal->slot[id];
+
+	if (atomic_load_explicit(&slot->active, memory_order_acquire)) {
+		fr_strerror_printf("Worker ID %d is already in use", id);
+		return -1;
+	}
+
+	if (slot->ms_steal) {
+		worker->ms_steal = talloc_steal(worker, slot->ms_steal);
+		slot->ms_steal = NULL;
+
+	} else {
+		worker->ms_steal = fr_message_set_create(worker, worker->message_set_size,
+							 sizeof(fr_channel_data_t),
+							 worker->ring_buffer_size);
+		if (!worker->ms_steal) {
+			fr_strerror_printf("Failed creating message set: %s", fr_strerror());
+			return -1;
+		}
+	}
+
+	PTHREAD_MUTEX_LOCK(&slot->mutex);
+	slot->kq = worker->kq;
+	slot->ident = fr_event_user_insert(worker->el, fr_worker_steal_evfilt_user, worker);
+	if (!slot->ident) {
+		PTHREAD_MUTEX_UNLOCK(&slot->mutex);
+		fr_strerror_printf("Failed updating event list: %s", fr_strerror());
+		TALLOC_FREE(worker->ms_steal);
+		return -1;
+	}
+
+	worker->steal = steal;
+	worker->slot = slot;
+
+	/*
+	 *	Other workers may now use kq / ident.
+	 */
+	atomic_store_explicit(&slot->active, true, memory_order_release);
+	PTHREAD_MUTEX_UNLOCK(&slot->mutex);
+
+	return 0;
+}
+
 /** Get the KQ for the worker
  *
  * @param[in] worker the worker data structure
@@ -1146,6 +2297,53 @@ fr_event_list_t *fr_worker_el(fr_worker_t *worker)
 }
 
 
+/** Retire a worker
+ *
+ *  The worker stops stealing messages from other workers, and exits
+ *  once all of the networks have closed their channels to it, and it
+ *  has finished all of its requests.  The caller should then close
+ *  the channels via fr_network_worker_delete().
+ *
+ *  This function is thread-safe.
+ *
+ * @param[in] worker the worker data structure to manage
+ */
+void fr_worker_retire(fr_worker_t *worker)
+{
+	atomic_store_explicit(&worker->retiring, true, memory_order_relaxed);
+
+	/*
+	 *	Wake the worker up, so that it notices.
+	 */
+	(void) fr_event_user_trigger(worker->kq, worker->aq_ident);
+}
+
+/** Get the CPU time spent by the worker processing requests
+ *
+ *  This function is thread-safe.  The value is updated once per pass
+ *  through the workers event loop.
+ *
+ * @param[in] worker the worker data structure
+ * @return the time spent processing requests
+ */
+fr_time_t fr_worker_running_time(fr_worker_t *worker)
+{
+	return atomic_load_explicit(&worker->running, memory_order_relaxed);
+}
+
+/** Get the number of channels which are open to the worker
+ *
+ *  This function is thread-safe.  The value is updated once per pass
+ *  through the workers event loop.
+ *
+ * @param[in] worker the worker data structure
+ * @return the number of open channels
+ */
+int fr_worker_num_channels(fr_worker_t *worker)
+{
+	return atomic_load_explicit(&worker->open_channels, memory_order_relaxed);
+}
+
 /** Signal a worker to exit
  *
  *  WARNING: This may be called from another thread!  Care is required.
@@ -1162,6 +2360,7 @@ void fr_worker_exit(fr_worker_t *worker)
 
 static void fr_worker_post_event(UNUSED fr_event_list_t *el, UNUSED struct timeval *when, void *uctx)
 {
+	int i;
 	fr_time_t now;
 	REQUEST *request;
 	fr_worker_t *worker = uctx;
@@ -1175,9 +2374,9 @@ static void fr_worker_post_event(UNUSED fr_event_list_t *el, UNUSED struct timev
 	 *
 	 *	@todo - move this to an event list timer.
 	 */
-	if ((now - worker->checked_timeout) > (NANOSEC / 10)) {
+	if ((fr_time_coarse() - worker->checked_timeout) > (NANOSEC / 10)) {
 		fr_log(worker->log, L_DBG, "\t%schecking timeouts", worker->name);
-		fr_worker_check_timeouts(worker, now);
+		fr_worker_check_timeouts(worker, fr_time_coarse());
 	}
 
 	/*
@@ -1188,17 +2387,43 @@ static void fr_worker_post_event(UNUSED fr_event_list_t *el, UNUSED struct timev
 	 *	for too long.
 	 */
 	request = fr_worker_get_request(worker, now);
-	if (!request) return;
+	if (request) {
+		rad_assert(request->async->process != NULL);
+		rad_assert(request->async->listen != NULL);
 
-	rad_assert(request->async->process != NULL);
-	rad_assert(request->async->listen != NULL);
+		/*
+		 *	Run the request, and either track it as
+		 *	yielded, or send a reply.
+		 */
+		fr_log(worker->log, L_DBG, "\t%srunning request (%"PRIu64")", worker->name, request->number);
+		fr_worker_run_request(worker, request);
+	}
+
+	/*
+	 *	Send one signal per channel for all of the replies
+	 *	we've sent in this pass.
+	 */
+	for (i = 0; i < worker->max_channels; i++) {
+		if (!worker->channel[i]) continue;
+
+		if (fr_channel_worker_flush(worker->channel[i]) < 0) {
+			fr_log(worker->log, L_DBG, "\t%sfails signaling channel", worker->name);
+		}
+	}
+
+	atomic_store_explicit(&worker->running, worker->tracking.running, memory_order_relaxed);
+	atomic_store_explicit(&worker->open_channels, worker->num_channels, memory_order_relaxed);
 
 	/*
-	 *	Run the request, and either track it as
-	 *	yielded, or send a reply.
+	 *	We've been retired, and the networks have closed all
+	 *	of their channels to us.  Any requests we stole have
+	 *	been replied to, so nothing refers to us any more.
 	 */
-	fr_log(worker->log, L_DBG, "\t%srunning request (%"PRIu64")", worker->name, request->number);
-	fr_worker_run_request(worker, request);
+	if (atomic_load_explicit(&worker->retiring, memory_order_relaxed) &&
+	    !worker->num_channels && (worker->time_order.next == &worker->time_order)) {
+		fr_log(worker->log, L_INFO, "\t%sretired", worker->name);
+		fr_worker_exit(worker);
+	}
 }
 
 
@@ -1237,16 +2462,44 @@ void fr_worker(fr_worker_t *worker)
 		}
 
 		/*
-		 *	Service outstanding events.
+		 *	Timeout checks only need the time as of this
+		 *	pass through the loop.
 		 */
-		if (num_events > 0) {
-			fr_log(worker->log, L_DBG, "\t%sservicing events", worker->name);
-			fr_event_service(worker->el);
-		}
+		(void) fr_time_coarse_update();
+
+		/*
+		 *	Service outstanding events.  We do this even
+		 *	if there are no new events, so that we drain
+		 *	the whole burst of messages from the network
+		 *	before going back to sleep.
+		 */
+		fr_log(worker->log, L_DBG, "\t%sservicing events", worker->name);
+		fr_event_service(worker->el);
 	}
 }
 
 
+/** Print the latency histograms for one packet type
+ *
+ */
+static void fr_worker_latency_debug(fr_worker_latency_set_t *set, char const *name, FILE *fp)
+{
+	static char const *names[FR_WORKER_LATENCY_MAX] = {
+		[FR_WORKER_LATENCY_QUEUED] = "queued",
+		[FR_WORKER_LATENCY_DECODE] = "decode",
+		[FR_WORKER_LATENCY_RUNNING] = "running",
+		[FR_WORKER_LATENCY_YIELDED] = "yielded",
+		[FR_WORKER_LATENCY_TOTAL] = "total",
+	};
+	int i;
+
+	fprintf(fp, "\tlatency (%s)\n", name);
+
+	for (i = 0; i < FR_WORKER_LATENCY_MAX; i++) {
+		fr_time_histogram_debug(&set->histogram[i], names[i], fp);
+	}
+}
+
 /** Print debug information about the worker structure
  *
  * @param[in] worker the worker
@@ -1254,17 +2507,192 @@ void fr_worker(fr_worker_t *worker)
  */
 void fr_worker_debug(fr_worker_t *worker, FILE *fp)
 {
+	int i;
+
 	WORKER_VERIFY;
 
 	fprintf(fp, "\tkq = %d\n", worker->kq);
 	fprintf(fp, "\tnum_channels = %d\n", worker->num_channels);
 	fprintf(fp, "\tnum_requests = %d\n", worker->num_requests);
+	fprintf(fp, "\tnum_stolen = %d\n", worker->num_stolen);
+	fprintf(fp, "\tnum_expired = %d\n", worker->num_expired);
 
 	fprintf(fp, "\tcalculated (predicted) total CPU time = %zd\n", worker->tracking.predicted * worker->num_requests);
 	fprintf(fp, "\tcalculated (counted) per request time = %zd\n", worker->tracking.running / worker->num_requests);
 
 	fr_time_tracking_debug(&worker->tracking, fp);
 
+	fr_worker_latency_debug(&worker->latency, "all", fp);
+	if (worker->num_shadow) fr_worker_latency_debug(&worker->shadow, "mirrored", fp);
+
+	for (i = 0; i < FR_MAX_PACKET_CODE; i++) {
+		fr_worker_latency_set_t *set;
+		char name[32];
+
+		set = atomic_load_explicit(&worker->latency_by_code[i], memory_order_acquire);
+		if (!set) continue;
+
+		snprintf(name, sizeof(name), "code %d", i);
+		fr_worker_latency_debug(set, name, fp);
+	}
+}
+
+/** Measure the memory used by the worker's message sets
+ *
+ */
+static size_t fr_worker_message_memory(fr_worker_t *worker)
+{
+	size_t	size = 0;
+	void	*ms;
+	int	i;
+
+	for (i = 0; i < worker->max_channels; i++) {
+		if (!worker->channel[i]) continue;
+
+		ms = fr_channel_worker_ctx_get(worker->channel[i]);
+		if (ms) size += talloc_total_size(ms);
+	}
+
+	if (worker->ms_steal) size += talloc_total_size(worker->ms_steal);
+
+	return size;
+}
+
+/** Get a snapshot of the worker's statistics
+ *
+ *  This function must be called from the worker thread.  Other
+ *  threads should use fr_worker_stats_request().
+ *
+ * @param[in] worker the worker
+ * @param[out] stats where the statistics are written
+ */
+void fr_worker_stats(fr_worker_t *worker, fr_worker_stats_t *stats)
+{
+	fr_dlist_t	*entry;
+	fr_time_t	now;
+
+	WORKER_VERIFY;
+
+	stats->num_channels = worker->num_channels;
+	stats->num_requests = worker->num_requests;
+	stats->num_decoded = worker->num_decoded;
+	stats->num_replies = worker->num_replies;
+	stats->num_timeouts = worker->num_timeouts;
+	stats->num_expired = worker->num_expired;
+	stats->num_stolen = worker->num_stolen;
+	stats->num_pool_overflows = worker->num_pool_overflows;
+	stats->num_shadow = worker->num_shadow;
+
+	stats->to_decode = fr_heap_num_elements(worker->to_decode.heap);
+	stats->localized = fr_heap_num_elements(worker->localized.heap);
+	stats->runnable = fr_heap_num_elements(worker->runnable);
+
+	stats->running = worker->tracking.running;
+	stats->waiting = worker->tracking.waiting;
+	stats->predicted = worker->tracking.predicted;
+	stats->shadow_running = worker->shadow_running;
+
+	stats->retiring = atomic_load_explicit(&worker->retiring, memory_order_relaxed);
+
+	/*
+	 *	Only this thread allocates in the message sets, so
+	 *	this is where they're measured.
+	 */
+	if (worker->memory) fr_memory_update(worker->memory, &worker->memory_used, fr_worker_message_memory(worker));
+
+	/*
+	 *	The oldest requests are at the tail of the time
+	 *	ordered list.
+	 */
+	stats->num_oldest = 0;
+	now = fr_time();
+	for (entry = FR_DLIST_TAIL(worker->time_order);
+	     entry && (stats->num_oldest < FR_WORKER_STATS_OLDEST);
+	     entry = FR_DLIST_PREV(worker->time_order, entry)) {
+		fr_worker_stats_request_t *old = &stats->oldest[stats->num_oldest++];
+		fr_async_t *async = fr_ptr_to_type(fr_async_t, time_order, entry);
+		REQUEST *request = talloc_parent(async);
+
+		old->number = request->number;
+		old->elapsed = (now > async->recv_time) ? now - async->recv_time : 0;
+		strlcpy(old->component, request->component ? request->component : "", sizeof(old->component));
+		strlcpy(old->module, async->module ? async->module : "", sizeof(old->module));
+	}
+}
+
+/** Ask the worker thread for a snapshot of its statistics
+ *
+ *  The worker fills in a fr_worker_stats_t between requests, so the
+ *  counters are read without locking, and are consistent with each
+ *  other.
+ *
+ * @param[in] worker the worker
+ * @param[in] msg where the statistics are written, and who to tell
+ *	when they have been.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_worker_stats_request(fr_worker_t *worker, fr_control_stats_t *msg)
+{
+	int rcode;
+
+	WORKER_VERIFY;
+
+	PTHREAD_MUTEX_LOCK(&worker->mutex);
+	rcode = fr_control_message_send(worker->control, worker->rb, FR_CONTROL_ID_STATS, msg, sizeof(*msg));
+	PTHREAD_MUTEX_UNLOCK(&worker->mutex);
+
+	return rcode;
+}
+
+/** Merge a worker's latency histogram into another one
+ *
+ *  This may be called from any thread, while the worker is running.
+ *  To get figures for a group of workers, zero the output histogram,
+ *  and merge each worker into it.
+ *
+ * @param[in] worker the worker
+ * @param[out] out the histogram to merge into
+ * @param[in] type the type of latency
+ * @param[in] code the packet code, or 0 for all packet types.  Must be 0
+ *	for mirrored requests.
+ * @param[in] shadow whether to merge the histogram of mirrored requests,
+ *	instead of production traffic.
+ * @return
+ *	- <0 on error
+ *	- 0 on success, even if the worker hasn't seen that packet code.
+ */
+int fr_worker_latency_merge(fr_worker_t *worker, fr_time_histogram_t *out,
+			    fr_worker_latency_t type, unsigned int code, bool shadow)
+{
+	fr_worker_latency_set_t *set;
+
+	if (type >= FR_WORKER_LATENCY_MAX) {
+		fr_strerror_printf("Invalid latency type %d", type);
+		return -1;
+	}
+
+	if (code >= FR_MAX_PACKET_CODE) {
+		fr_strerror_printf("Invalid packet code %u", code);
+		return -1;
+	}
+
+	if (shadow) {
+		if (code) {
+			fr_strerror_printf("Mirrored requests aren't counted by packet code");
+			return -1;
+		}
+		set = &worker->shadow;
+	} else if (!code) {
+		set = &worker->latency;
+	} else {
+		set = atomic_load_explicit(&worker->latency_by_code[code], memory_order_acquire);
+		if (!set) return 0;
+	}
+
+	fr_time_histogram_merge(out, &set->histogram[type]);
+	return 0;
 }
 
 /** Create a channel to the worker
@@ -44,13 +44,81 @@ extern "C" {
  */
 typedef struct fr_worker_t fr_worker_t;
 
+/**
+ *  A group of workers which can take surplus messages from each other.
+ */
+typedef struct fr_worker_steal_t fr_worker_steal_t;
+
+/**
+ *  The latency histograms kept by each worker.
+ */
+typedef enum fr_worker_latency_t {
+	FR_WORKER_LATENCY_QUEUED = 0,		//!< from receipt by the network thread, to decode
+	FR_WORKER_LATENCY_DECODE,		//!< decoding the packet
+	FR_WORKER_LATENCY_RUNNING,		//!< running the request, including decode and encode
+	FR_WORKER_LATENCY_YIELDED,		//!< yielded, waiting for something to happen
+	FR_WORKER_LATENCY_TOTAL,		//!< from receipt by the network thread, to the reply
+	FR_WORKER_LATENCY_MAX
+} fr_worker_latency_t;
+
+#define FR_WORKER_STATS_OLDEST	(5)		//!< how many of the oldest requests are in a snapshot
+
+/**
+ *  One of the oldest requests in a worker, for "show top".
+ */
+typedef struct fr_worker_stats_request_t {
+	uint64_t		number;		//!< of the request
+	fr_time_t		elapsed;	//!< since the request was received
+	char			component[32];	//!< the section the request is in, or ""
+	char			module[32];	//!< the module the request is in, or waiting for, or ""
+} fr_worker_stats_request_t;
+
+/**
+ *  A snapshot of a worker's statistics.
+ */
+typedef struct fr_worker_stats_t {
+	int			num_channels;	//!< number of channels from networks
+	int			num_requests;	//!< number of requests processed
+	int			num_decoded;	//!< number of messages which have been decoded
+	int			num_replies;	//!< number of messages which were replied to
+	int			num_timeouts;	//!< number of messages which timed out
+	int			num_expired;	//!< number of requests dropped because they were past their deadline
+	int			num_stolen;	//!< number of messages stolen from other workers
+	int			num_pool_overflows; //!< requests which needed more memory than their talloc pool had
+	int			num_shadow;	//!< number of mirrored requests processed
+
+	int			to_decode;	//!< messages waiting to be decoded
+	int			localized;	//!< localized messages waiting to be decoded
+	int			runnable;	//!< requests which are ready to run
+
+	fr_time_t		running;	//!< total time spent running requests
+	fr_time_t		waiting;	//!< total time requests spent waiting
+	fr_time_t		predicted;	//!< predicted processing time for one request
+	fr_time_t		shadow_running;	//!< time spent running mirrored requests, included in "running"
+
+	bool			retiring;	//!< the worker will exit once its channels have closed
+
+	int			num_oldest;	//!< number of entries in "oldest"
+	fr_worker_stats_request_t oldest[FR_WORKER_STATS_OLDEST];	//!< the requests which have been
+									//!< running the longest, oldest first
+} fr_worker_stats_t;
+
 fr_worker_t *fr_worker_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t const *logger, uint32_t flags) CC_HINT(nonnull(2,3));
+fr_worker_steal_t *fr_worker_steal_create(TALLOC_CTX *ctx, int num_workers);
+int fr_worker_steal_join(fr_worker_t *worker, fr_worker_steal_t *steal, int id) CC_HINT(nonnull);
 void fr_worker_destroy(fr_worker_t *worker) CC_HINT(nonnull);
 int fr_worker_kq(fr_worker_t *worker) CC_HINT(nonnull);
 fr_event_list_t *fr_worker_el(fr_worker_t *worker) CC_HINT(nonnull);
 void fr_worker(fr_worker_t *worker) CC_HINT(nonnull);
 void fr_worker_exit(fr_worker_t *worker) CC_HINT(nonnull);
+void fr_worker_retire(fr_worker_t *worker) CC_HINT(nonnull);
+fr_time_t fr_worker_running_time(fr_worker_t *worker) CC_HINT(nonnull);
+int fr_worker_num_channels(fr_worker_t *worker) CC_HINT(nonnull);
 void fr_worker_debug(fr_worker_t *worker, FILE *fp) CC_HINT(nonnull);
+void fr_worker_stats(fr_worker_t *worker, fr_worker_stats_t *stats) CC_HINT(nonnull);
+int fr_worker_stats_request(fr_worker_t *worker, fr_control_stats_t *msg) CC_HINT(nonnull);
+int fr_worker_latency_merge(fr_worker_t *worker, fr_time_histogram_t *out,
+			    fr_worker_latency_t type, unsigned int code, bool shadow) CC_HINT(nonnull);
 void fr_worker_name(fr_worker_t *worker, char const *name) CC_HINT(nonnull);
 fr_channel_t *fr_worker_channel_create(fr_worker_t *worker, TALLOC_CTX *ctx, fr_control_t *master) CC_HINT(nonnull);
 
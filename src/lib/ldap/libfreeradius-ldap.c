@@ -539,6 +539,60 @@ fr_ldap_rcode_t fr_ldap_bind(REQUEST *request,
 	return status; /* caller closes the connection */
 }
 
+/** Send a simple bind request without waiting for the result
+ *
+ * The result must be retrieved with ldap_result, using the msgid written to msgid.
+ *
+ * @note SASL binds require multiple round trips, and can't be performed asynchronously.
+ *
+ * @param[out] msgid		to match response to request.
+ * @param[in] request		Current request, this may be NULL, in which case all
+ *				debug logging is done with radlog.
+ * @param[in] conn		to send the bind on.  No other operations should be sent
+ *				on this connection until the bind completes.
+ * @param[in] dn		of the user, may be NULL to bind anonymously.
+ * @param[in] password		of the user, may be NULL if no password is specified.
+ * @param[in] serverctrls	Controls to pass to the server.  May be NULL.
+ * @param[in] clientctrls	Controls for ldap_sasl_bind.  May be NULL.
+ * @return
+ *	- LDAP_PROC_SUCCESS if the bind request was sent.
+ *	- LDAP_PROC_ERROR if the bind request couldn't be sent.
+ */
+fr_ldap_rcode_t fr_ldap_bind_async(int *msgid, REQUEST *request, fr_ldap_conn_t *conn,
+				   char const *dn, char const *password,
+				   LDAPControl **serverctrls, LDAPControl **clientctrls)
+{
+	fr_ldap_handle_config_t const	*handle_config = conn->config;
+	struct berval			cred;
+	int				ret;
+
+	rad_assert(conn && conn->handle);
+
+	/*
+	 *	Bind as anonymous user
+	 */
+	if (!dn) dn = "";
+
+	if (password) {
+		memcpy(&cred.bv_val, &password, sizeof(cred.bv_val));
+		cred.bv_len = talloc_array_length(password) - 1;
+	} else {
+		cred.bv_val = NULL;
+		cred.bv_len = 0;
+	}
+
+	ret = ldap_sasl_bind(conn->handle, dn, LDAP_SASL_SIMPLE, &cred, serverctrls, clientctrls, msgid);
+	if ((ret != LDAP_SUCCESS) || (*msgid < 0)) {
+		ROPTIONAL(REDEBUG, ERROR, "Failed sending bind as \"%s\": %s",
+			  *dn ? dn : "(anonymous)", ldap_err2string(ret));
+		return LDAP_PROC_ERROR;
+	}
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Sent bind as \"%s\" (msgid %i)", *dn ? dn : "(anonymous)", *msgid);
+
+	return LDAP_PROC_SUCCESS;
+}
+
 /** Search for something in the LDAP directory
  *
  * Binds as the administrative user and performs a search, dealing with any errors.
@@ -375,6 +375,10 @@ fr_ldap_rcode_t	fr_ldap_bind(REQUEST *request,
 			     struct timeval const *timeout,
 			     LDAPControl **serverctrls, LDAPControl **clientctrls);
 
+fr_ldap_rcode_t	fr_ldap_bind_async(int *msgid, REQUEST *request, fr_ldap_conn_t *conn,
+				   char const *dn, char const *password,
+				   LDAPControl **serverctrls, LDAPControl **clientctrls);
+
 char const	*fr_ldap_error_str(fr_ldap_conn_t const *conn);
 
 fr_ldap_rcode_t	fr_ldap_search(LDAPMessage **result, REQUEST *request,
@@ -21,6 +21,7 @@ SOURCES		:= base64.c \
 		   inet.c \
 		   isaac.c \
 		   log.c \
+		   log_async.c \
 		   mem.c \
 		   misc.c \
 		   missing.c \
@@ -44,8 +45,10 @@ SOURCES		:= base64.c \
 		   socket.c \
 		   talloc.c \
 		   token.c \
+		   trie.c \
 		   udpfromto.c \
 		   udp.c \
+		   udp_uring.c \
 		   value.c \
 		   version.c
 
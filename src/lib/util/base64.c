@@ -54,6 +54,23 @@ size_t fr_base64_encode(char *out, size_t outlen, uint8_t const *in, size_t inle
 		return -1;
 	}
 
+	/*
+	 *	Whole groups of three bytes, without the checks for
+	 *	the end of the input.
+	 */
+	while (inlen > 3) {
+		uint32_t group = (in[0] << 16) | (in[1] << 8) | in[2];
+
+		p[0] = b64str[(group >> 18) & 0x3f];
+		p[1] = b64str[(group >> 12) & 0x3f];
+		p[2] = b64str[(group >> 6) & 0x3f];
+		p[3] = b64str[group & 0x3f];
+
+		p += 4;
+		in += 3;
+		inlen -= 3;
+	}
+
 	while (inlen) {
 		*p++ = b64str[(in[0] >> 2) & 0x3f];
 		*p++ = b64str[((in[0] << 4) + (--inlen ? in[1] >> 4 : 0)) & 0x3f];
@@ -259,6 +276,26 @@ ssize_t fr_base64_decode(uint8_t *out, size_t outlen, char const *in, size_t inl
 		return -1;
 	}
 
+	/*
+	 *	Whole groups of four characters, which can't be the
+	 *	last group, so can't have padding.  The characters are
+	 *	checked together.  If any of them are invalid, the loop
+	 *	below finds which.
+	 */
+	while (inlen > 4) {
+		int a = b64[us(in[0])], b = b64[us(in[1])], c = b64[us(in[2])], d = b64[us(in[3])];
+
+		if ((a | b | c | d) < 0) break;
+
+		p[0] = (a << 2) | (b >> 4);
+		p[1] = ((b << 4) & 0xf0) | (c >> 2);
+		p[2] = ((c << 6) & 0xc0) | d;
+
+		p += 3;
+		in += 4;
+		inlen -= 4;
+	}
+
 	while (inlen >= 2) {
 		if (!fr_is_base64(in[0]) || !fr_is_base64(in[1])) {
 			break;
@@ -249,14 +249,6 @@ bool const fr_dict_non_data_types[FR_TYPE_MAX + 1] = {
 #  define INTERNAL_IF_NULL(_dict) if (!_dict) _dict = fr_dict_internal
 #endif
 
-/** Empty callback for hash table initialization
- *
- */
-static int hash_null_callback(UNUSED void *ctx, UNUSED void *data)
-{
-	return 0;
-}
-
 static void hash_pool_free(void *to_free)
 {
 	talloc_free(to_free);
@@ -272,9 +264,15 @@ static uint32_t dict_hash_name(char const *name)
 	uint32_t hash = FNV_MAGIC_INIT;
 	char const *p;
 
+	/*
+	 *	Names are ASCII, so fold the case here, instead of
+	 *	calling the locale aware isalpha() / tolower() for
+	 *	every character.  This is called for every attribute,
+	 *	vendor and enum name as the dictionaries are loaded.
+	 */
 	for (p = name; *p != '\0'; p++) {
 		int c = *(unsigned char const *)p;
-		if (isalpha(c)) c = tolower(c);
+		if ((c >= 'A') && (c <= 'Z')) c += 'a' - 'A';
 
 		hash *= FNV_MAGIC_PRIME;
 		hash ^= (uint32_t)(c & 0xff);
@@ -2323,9 +2321,10 @@ static int _dict_from_file(dict_from_file_ctx_t *ctx,
 	}
 
 	/*
-	 *	If fopen works, this works.
+	 *	If fopen works, this works.  Use the open file, so
+	 *	we don't look up the path a second time.
 	 */
-	if (stat(fn, &statbuf) < 0) {
+	if (fstat(fileno(fp), &statbuf) < 0) {
 		fclose(fp);
 		return -1;
 	}
@@ -2839,18 +2838,6 @@ int fr_dict_from_file(TALLOC_CTX *ctx, fr_dict_t **out, char const *dir, char co
 		}
 	}
 
-	/*
-	 *	Walk over all of the hash tables to ensure they're
-	 *	initialized.  We do this because the threads may perform
-	 *	lookups, and we don't want multi-threaded re-ordering
-	 *	of the table entries.  That would be bad.
-	 */
-	fr_hash_table_walk(dict->vendors_by_name, hash_null_callback, NULL);
-	fr_hash_table_walk(dict->vendors_by_num, hash_null_callback, NULL);
-
-	fr_hash_table_walk(dict->values_by_da, hash_null_callback, NULL);
-	fr_hash_table_walk(dict->values_by_alias, hash_null_callback, NULL);
-
 	*out = dict;
 
 	return 0;
@@ -4060,8 +4047,13 @@ fr_dict_attr_t const *fr_dict_attr_by_name(fr_dict_t const *dict, char const *na
 	if (!name) return NULL;
 	INTERNAL_IF_NULL(dict);
 
+	/*
+	 *	Names longer than the maximum can't be in the
+	 *	dictionary.  Don't look up a truncated copy, as that
+	 *	could match a different attribute.
+	 */
 	da = (fr_dict_attr_t *)buffer;
-	strlcpy(da->name, name, FR_DICT_ATTR_MAX_NAME_LEN + 1);
+	if (strlcpy(da->name, name, FR_DICT_ATTR_MAX_NAME_LEN + 1) > FR_DICT_ATTR_MAX_NAME_LEN) return NULL;
 
 	return fr_hash_table_finddata(dict->attributes_by_name, da);
 }
@@ -4146,7 +4138,7 @@ inline fr_dict_attr_t const *fr_dict_attr_child_by_da(fr_dict_attr_t const *pare
 	 *	Child arrays may be trimmed back to save memory.
 	 *	Check that so we don't SEGV.
 	 */
-	if ((child->attr & 0xff) > talloc_array_length(parent->children)) return NULL;
+	if ((child->attr & 0xff) >= talloc_array_length(parent->children)) return NULL;
 
 	bin = parent->children[child->attr & 0xff];
 	for (;;) {
@@ -4187,7 +4179,7 @@ inline fr_dict_attr_t const *fr_dict_attr_child_by_num(fr_dict_attr_t const *par
 	 *	Child arrays may be trimmed back to save memory.
 	 *	Check that so we don't SEGV.
 	 */
-	if ((attr & 0xff) > talloc_array_length(parent->children)) return NULL;
+	if ((attr & 0xff) >= talloc_array_length(parent->children)) return NULL;
 
 	bin = parent->children[attr & 0xff];
 	for (;;) {
@@ -21,6 +21,19 @@
  * @note By non-thread-safe we mean multiple threads can't insert/delete events concurrently
  *	without synchronization.
  *
+ * When built with WITH_EVENT_EPOLL (Linux only), the event list
+ * uses epoll, eventfd for user events, and the epoll_wait() timeout
+ * for timers, instead of kqueue.  The API is the same.  In that
+ * mode, #fr_event_list_kq returns the epoll descriptor, and user
+ * events MUST be signalled with #fr_event_user_trigger.
+ *
+ * Timers normally go into a binary heap.  If the timing wheel is
+ * enabled with #fr_event_list_timer_wheel, timers which are due more
+ * than a millisecond in the future go onto a hierarchical timing
+ * wheel instead, where insert and delete are O(1).  Timers are moved
+ * from the wheel into the heap when their millisecond comes around,
+ * so they still fire in order, and at the time they were scheduled.
+ *
  * @copyright 2007-2016 The FreeRADIUS server project
  * @copyright 2016 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
  * @copyright 2007 Alan DeKok <aland@ox.org>
@@ -32,8 +45,34 @@ RCSID("$Id$")
 #include <freeradius-devel/event.h>
 #include <freeradius-devel/io/time.h>
 
+#ifdef WITH_EVENT_EPOLL
+#  ifndef __linux__
+#    error WITH_EVENT_EPOLL requires Linux
+#  endif
+#  include <sys/epoll.h>
+#  include <sys/eventfd.h>
+
+/*
+ *	epoll data for user events has the low bit set.  The exit
+ *	event has NULL data.  Everything else is an fr_event_fd_t.
+ */
+#  define EVENT_EPOLL_USER	((uintptr_t) 1)
+#endif
+
 #define FR_EV_BATCH_FDS (256)
 
+/*
+ *	The timing wheel has 4 levels of 64 slots.  Each slot on
+ *	level 0 is one millisecond, each slot on level 1 is 64ms,
+ *	and so on.  That covers about 4.6 hours.  Timers further in
+ *	the future than that go into the heap.
+ */
+#define EVENT_WHEEL_LEVELS	(4)
+#define EVENT_WHEEL_BITS	(6)
+#define EVENT_WHEEL_SLOTS	(1 << EVENT_WHEEL_BITS)
+#define EVENT_WHEEL_MASK	(EVENT_WHEEL_SLOTS - 1)
+#define EVENT_WHEEL_SHIFT(_level) ((_level) * EVENT_WHEEL_BITS)
+
 #undef USEC
 #define USEC (1000000)
 
@@ -52,6 +91,10 @@ struct fr_event_timer_t {
 
 	fr_event_timer_t const	**parent;		//!< Previous timer.
 	int			heap;			//!< Where to store opaque heap data.
+
+	fr_dlist_t		entry;			//!< Entry in a timing wheel slot.
+	int			wheel;			//!< Level of the timing wheel this timer is on,
+							///< or -1 if it's in the heap.
 };
 
 /** A file descriptor event
@@ -134,7 +177,19 @@ struct fr_event_list_t {
 	fr_dlist_t		user_callbacks;		//!< EVFILT_USER callbacks
 	fr_dlist_t		post_callbacks;		//!< post-processing callbacks
 
+	bool			wheel_enabled;		//!< Put coarse timers on the timing wheel.
+	uint64_t		wheel_tick;		//!< Millisecond the timing wheel has been advanced to.
+	uint32_t		num_wheel;		//!< Number of timers on the timing wheel.
+	uint32_t		wheel_num[EVENT_WHEEL_LEVELS];	//!< Number of timers on each level.
+	fr_dlist_t		wheel[EVENT_WHEEL_LEVELS][EVENT_WHEEL_SLOTS];	//!< Slots of the timing wheel.
+
+#ifdef WITH_EVENT_EPOLL
+	int			exit_fd;		//!< eventfd used to wake the loop on exit.
+
+	struct epoll_event	events[FR_EV_BATCH_FDS]; /* so it doesn't go on the stack every time */
+#else
 	struct kevent		events[FR_EV_BATCH_FDS]; /* so it doesn't go on the stack every time */
+#endif
 };
 
 /** Compare two timer events to see which one should occur first
@@ -151,10 +206,10 @@ static int fr_event_timer_cmp(void const *a, void const *b)
 	int			ret;
 	fr_event_timer_t const	*ev_a = a, *ev_b = b;
 
-	ret = (ev_a->when.tv_sec < ev_b->when.tv_sec) - (ev_a->when.tv_sec > ev_b->when.tv_sec);
+	ret = (ev_a->when.tv_sec > ev_b->when.tv_sec) - (ev_a->when.tv_sec < ev_b->when.tv_sec);
 	if (ret != 0) return ret;
 
-	return (ev_a->when.tv_usec < ev_b->when.tv_usec) - (ev_a->when.tv_usec > ev_b->when.tv_usec);
+	return (ev_a->when.tv_usec > ev_b->when.tv_usec) - (ev_a->when.tv_usec < ev_b->when.tv_usec);
 }
 
 /** Compare two file descriptor handles
@@ -192,7 +247,7 @@ int fr_event_list_num_elements(fr_event_list_t *el)
 {
 	if (unlikely(!el)) return -1;
 
-	return fr_heap_num_elements(el->times);
+	return fr_heap_num_elements(el->times) + el->num_wheel;
 }
 
 /** Return the kq associated with an event list.
@@ -281,12 +336,17 @@ int fr_event_fd_delete(fr_event_list_t *el, int fd)
  */
 static int _fr_event_fd_free(fr_event_fd_t *ef)
 {
-	struct kevent	evset[2];
-
 	fr_event_list_t	*el = talloc_parent(ef);
 
 	if (likely(ef->is_registered)) {
-		int count = 0;
+#ifdef WITH_EVENT_EPOLL
+		if (unlikely(epoll_ctl(el->kq, EPOLL_CTL_DEL, ef->fd, NULL) < 0)) {
+			fr_strerror_printf("Failed removing filters for FD %i: %s", ef->fd, fr_syserror(errno));
+			return -1;
+		}
+#else
+		struct kevent	evset[2];
+		int		count = 0;
 
 		if (ef->read) EV_SET(&evset[count++], ef->fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
 		if (ef->write) EV_SET(&evset[count++], ef->fd, EVFILT_WRITE, EV_DELETE, 0, 0, 0);
@@ -295,6 +355,7 @@ static int _fr_event_fd_free(fr_event_fd_t *ef)
 			fr_strerror_printf("Failed removing filters for FD %i: %s", ef->fd, fr_syserror(errno));
 			return -1;
 		}
+#endif
 	}
 	rbtree_deletebydata(el->fds, ef);
 	ef->is_registered = false;		/* For debugging */
@@ -304,6 +365,22 @@ static int _fr_event_fd_free(fr_event_fd_t *ef)
 	return 0;
 }
 
+#ifdef WITH_EVENT_EPOLL
+/** Return the epoll events for a set of callbacks
+ *
+ *  EPOLLRDHUP lets us report EOF in the same way as kqueue's EV_EOF.
+ */
+static inline uint32_t event_epoll_mask(fr_event_fd_handler_t read_fn, fr_event_fd_handler_t write_fn)
+{
+	uint32_t events = 0;
+
+	if (read_fn) events |= EPOLLIN | EPOLLRDHUP;
+	if (write_fn) events |= EPOLLOUT;
+
+	return events;
+}
+#endif
+
 /** Associate a callback with an file descriptor
  *
  * @param[in] ctx	to bind lifetime of the event to.
@@ -323,8 +400,12 @@ int fr_event_fd_insert(TALLOC_CTX *ctx, fr_event_list_t *el, int fd,
 		       fr_event_fd_error_handler_t error,
 		       void *uctx)
 {
+#ifdef WITH_EVENT_EPOLL
+	struct epoll_event ep;
+#else
 	int		count = 0;
 	struct kevent	evset[2];
+#endif
 	fr_event_fd_t	*ef, find;
 
 	if (unlikely(!el)) {
@@ -402,6 +483,25 @@ int fr_event_fd_insert(TALLOC_CTX *ctx, fr_event_list_t *el, int fd,
 
 		rbtree_insert(el->fds, ef);
 
+#ifdef WITH_EVENT_EPOLL
+		memset(&ep, 0, sizeof(ep));
+		ep.events = event_epoll_mask(read_fn, write_fn);
+		ep.data.ptr = ef;
+
+		if (unlikely(epoll_ctl(el->kq, EPOLL_CTL_ADD, fd, &ep) < 0)) {
+			/*
+			 *	epoll can't watch regular files.
+			 */
+			if (errno == EPERM) {
+				fr_strerror_printf("Failed adding filter for FD %i: epoll does not support regular files",
+						   fd);
+			} else {
+				fr_strerror_printf("Failed adding filter for FD %i: %s", fd, fr_syserror(errno));
+			}
+			talloc_free(ef);
+			return -1;
+		}
+#else
 		if (read_fn) EV_SET(&evset[count++], fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, ef);
 		if (write_fn) EV_SET(&evset[count++], fd, EVFILT_WRITE, EV_ADD | EV_ENABLE, 0, 0, ef);
 
@@ -410,6 +510,7 @@ int fr_event_fd_insert(TALLOC_CTX *ctx, fr_event_list_t *el, int fd,
 			talloc_free(ef);
 			return -1;
 		}
+#endif
 
 		ef->uctx = uctx;
 		ef->read = read_fn;
@@ -421,6 +522,21 @@ int fr_event_fd_insert(TALLOC_CTX *ctx, fr_event_list_t *el, int fd,
 		return 0;
 	}
 
+#ifdef WITH_EVENT_EPOLL
+	/*
+	 *	One registration covers both read and write.
+	 */
+	if ((!ef->read != !read_fn) || (!ef->write != !write_fn)) {
+		memset(&ep, 0, sizeof(ep));
+		ep.events = event_epoll_mask(read_fn, write_fn);
+		ep.data.ptr = ef;
+
+		if (unlikely(epoll_ctl(el->kq, EPOLL_CTL_MOD, fd, &ep) < 0)) {
+			fr_strerror_printf("Failed modifying filters for FD %i: %s", fd, fr_syserror(errno));
+			return -1;
+		}
+	}
+#else
 	/*
 	 *	Calculate the diff between the filters that
 	 *	should be registered and the filters we need.
@@ -442,6 +558,7 @@ int fr_event_fd_insert(TALLOC_CTX *ctx, fr_event_list_t *el, int fd,
 			return -1;
 		}
 	}
+#endif
 
 	/*
 	 *	I/O handler may delete an event, then re-add it.
@@ -458,6 +575,253 @@ int fr_event_fd_insert(TALLOC_CTX *ctx, fr_event_list_t *el, int fd,
 }
 
 
+/** Convert a timeval to a timing wheel tick
+ *
+ */
+static inline uint64_t event_wheel_tick(struct timeval const *when)
+{
+	return ((uint64_t) when->tv_sec * 1000) + (when->tv_usec / 1000);
+}
+
+/** Put a timer onto the timing wheel
+ *
+ *  Timers which are due in the current millisecond, or which are
+ *  too far in the future for the wheel, are left for the heap.
+ *
+ * @param[in] el	containing the timing wheel.
+ * @param[in] ev	to insert.
+ * @return
+ *	- true if the timer is now on the wheel.
+ *	- false if the timer should go into the heap.
+ */
+static bool event_wheel_insert(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	uint64_t	tick;
+	int		level;
+
+	if (!el->wheel_enabled) return false;
+
+	tick = event_wheel_tick(&ev->when);
+	if (tick <= el->wheel_tick) return false;
+
+	/*
+	 *	Use the lowest level where the timer is less than a
+	 *	full turn of the wheel away.  For levels above 0, it
+	 *	is always at least one slot away, so we never have to
+	 *	look at the current slot of a level.
+	 */
+	for (level = 0; level < EVENT_WHEEL_LEVELS; level++) {
+		uint64_t slot = tick >> EVENT_WHEEL_SHIFT(level);
+
+		if ((slot - (el->wheel_tick >> EVENT_WHEEL_SHIFT(level))) >= EVENT_WHEEL_SLOTS) continue;
+
+		fr_dlist_insert_tail(&el->wheel[level][slot & EVENT_WHEEL_MASK], &ev->entry);
+		ev->wheel = level;
+		el->wheel_num[level]++;
+		el->num_wheel++;
+		return true;
+	}
+
+	return false;
+}
+
+/** Take a timer off the timing wheel
+ *
+ * @param[in] el	containing the timing wheel.
+ * @param[in] ev	to remove.
+ */
+static inline void event_wheel_remove(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	if (ev->wheel < 0) return;
+
+	fr_dlist_remove(&ev->entry);
+	el->wheel_num[ev->wheel]--;
+	el->num_wheel--;
+	ev->wheel = -1;
+}
+
+/** Move the timers in one slot of the timing wheel to a lower level, or into the heap
+ *
+ * @param[in] el	containing the timing wheel.
+ * @param[in] level	of the wheel.
+ * @param[in] slot	to empty.
+ */
+static void event_wheel_cascade(fr_event_list_t *el, int level, int slot)
+{
+	fr_dlist_t *head = &el->wheel[level][slot];
+
+	while (head->next != head) {
+		fr_event_timer_t *ev;
+
+		ev = fr_ptr_to_type(fr_event_timer_t, entry, head->next);
+		event_wheel_remove(el, ev);
+
+		if (event_wheel_insert(el, ev)) continue;
+
+		(void) fr_heap_insert(el->times, ev);
+	}
+}
+
+/** Advance the timing wheel to the current time
+ *
+ *  Timers which are due in a millisecond we've reached are moved into
+ *  the heap.  Slots with nothing lower down are skipped, so this is
+ *  cheap even when the event loop has been asleep for a long time.
+ *
+ * @param[in] el	containing the timing wheel.
+ * @param[in] now	the current time.
+ */
+static void event_wheel_advance(fr_event_list_t *el, struct timeval const *now)
+{
+	uint64_t	tick = event_wheel_tick(now);
+
+	while (el->wheel_tick < tick) {
+		uint64_t	next;
+		int		level;
+
+		/*
+		 *	Nothing happens until the next slot
+		 *	boundary of the lowest level which has
+		 *	timers.
+		 */
+		for (level = 0; level < EVENT_WHEEL_LEVELS; level++) {
+			if (el->wheel_num[level] > 0) break;
+		}
+		if (level == EVENT_WHEEL_LEVELS) break;
+
+		next = ((el->wheel_tick >> EVENT_WHEEL_SHIFT(level)) + 1) << EVENT_WHEEL_SHIFT(level);
+		if (next > tick) break;
+
+		el->wheel_tick = next;
+
+		/*
+		 *	Cascade the higher levels first, as their
+		 *	timers may end up in the level 0 slot which
+		 *	is due now.
+		 */
+		for (level = EVENT_WHEEL_LEVELS - 1; level > 0; level--) {
+			if ((next & ((((uint64_t) 1) << EVENT_WHEEL_SHIFT(level)) - 1)) != 0) continue;
+
+			event_wheel_cascade(el, level, (next >> EVENT_WHEEL_SHIFT(level)) & EVENT_WHEEL_MASK);
+		}
+		event_wheel_cascade(el, 0, next & EVENT_WHEEL_MASK);
+	}
+
+	if (el->wheel_tick < tick) el->wheel_tick = tick;
+}
+
+/** Find when the timing wheel next needs to be advanced
+ *
+ * @param[in] el	containing the timing wheel.
+ * @param[out] when	the start of the next slot which has timers.
+ * @return
+ *	- true if there are timers on the wheel.
+ *	- false if the wheel is empty.
+ */
+static bool event_wheel_next(fr_event_list_t *el, struct timeval *when)
+{
+	uint64_t	tick = 0;
+	int		level, i;
+
+	if (!el->num_wheel) return false;
+
+	for (level = 0; level < EVENT_WHEEL_LEVELS; level++) {
+		uint64_t base = el->wheel_tick >> EVENT_WHEEL_SHIFT(level);
+
+		if (!el->wheel_num[level]) continue;
+
+		for (i = 1; i < EVENT_WHEEL_SLOTS; i++) {
+			fr_dlist_t *head = &el->wheel[level][(base + i) & EVENT_WHEEL_MASK];
+			uint64_t start;
+
+			if (head->next == head) continue;
+
+			start = (base + i) << EVENT_WHEEL_SHIFT(level);
+			if (!tick || (start < tick)) tick = start;
+			break;
+		}
+	}
+
+	if (!fr_cond_assert(tick > 0)) return false;
+
+	when->tv_sec = tick / 1000;
+	when->tv_usec = (tick % 1000) * 1000;
+
+	return true;
+}
+
+/** Find when the next timer event is due
+ *
+ * @param[in] el	containing the timer events.
+ * @param[out] when	the next timer event is due.
+ * @return
+ *	- true if there are timer events.
+ *	- false if there are no timer events.
+ */
+static bool event_timer_next(fr_event_list_t *el, struct timeval *when)
+{
+	fr_event_timer_t	*ev;
+	struct timeval		next;
+
+	ev = fr_heap_peek(el->times);
+	if (!event_wheel_next(el, &next)) {
+		if (!ev) return false;
+
+		*when = ev->when;
+		return true;
+	}
+
+	if (ev && (fr_timeval_cmp(&ev->when, &next) < 0)) {
+		*when = ev->when;
+	} else {
+		*when = next;
+	}
+
+	return true;
+}
+
+/** Enable or disable the timing wheel for an event list
+ *
+ *  When enabled, timers due more than a millisecond in the future
+ *  go onto a hierarchical timing wheel, instead of into the heap.
+ *  Insert and delete are then O(1), which helps when there are
+ *  many timers, and most of them are deleted before they fire.
+ *
+ * @param[in] el	to change.
+ * @param[in] enable	whether or not to use the timing wheel.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_event_list_timer_wheel(fr_event_list_t *el, bool enable)
+{
+	int level, slot;
+
+	if (unlikely(!el)) return -1;
+
+	if (enable == el->wheel_enabled) return 0;
+
+	if (enable) {
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		el->wheel_tick = event_wheel_tick(&now);
+		el->wheel_enabled = true;
+		return 0;
+	}
+
+	/*
+	 *	With the wheel disabled, everything cascades into
+	 *	the heap.
+	 */
+	el->wheel_enabled = false;
+	for (level = 0; level < EVENT_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < EVENT_WHEEL_SLOTS; slot++) event_wheel_cascade(el, level, slot);
+	}
+
+	return 0;
+}
+
 /** Delete a timer event from the event list
  *
  * @param[in] el	to delete event from.
@@ -493,6 +857,11 @@ static int _event_timer_free(fr_event_timer_t *ev)
 	fr_event_list_t	*el = talloc_parent(ev);
 	int		ret;
 
+	if (ev->wheel >= 0) {
+		event_wheel_remove(el, ev);
+		return 0;
+	}
+
 	ret = fr_heap_extract(el->times, ev);
 
 	/*
@@ -571,6 +940,8 @@ int fr_event_timer_insert(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t
 		 */
 		if (ctx) fr_talloc_link_ctx(ctx, ev);
 
+		ev->heap = -1;
+		ev->wheel = -1;
 		talloc_set_destructor(ev, _event_timer_free);
 	} else {
 		memcpy(&ev, ev_p, sizeof(ev));	/* Not const to us */
@@ -592,7 +963,11 @@ int fr_event_timer_insert(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t
 		 *	Event may have fired, in which case the
 		 *	event will no longer be in the event loop.
 		 */
-		(void) fr_heap_extract(el->times, ev);
+		if (ev->wheel >= 0) {
+			event_wheel_remove(el, ev);
+		} else {
+			(void) fr_heap_extract(el->times, ev);
+		}
 	}
 
 	ev->when = *when;
@@ -601,7 +976,11 @@ int fr_event_timer_insert(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t
 	ev->linked_ctx = ctx;
 	ev->parent = ev_p;
 
-	if (unlikely(!fr_heap_insert(el->times, ev))) {
+	/*
+	 *	Coarse timers go onto the timing wheel, if it's
+	 *	enabled.  Everything else goes into the heap.
+	 */
+	if (!event_wheel_insert(el, ev) && unlikely(!fr_heap_insert(el->times, ev))) {
 		fr_strerror_printf("Failed inserting event into heap");
 		talloc_free(ev);
 		return -1;
@@ -613,6 +992,23 @@ int fr_event_timer_insert(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t
 }
 
 
+#ifdef WITH_EVENT_EPOLL
+/** Close the eventfd of a user event
+ *
+ * @param[in] user	to free.
+ * @return 0
+ */
+static int _event_user_free(fr_event_user_t *user)
+{
+	fr_event_list_t	*el = talloc_parent(user);
+
+	(void) epoll_ctl(el->kq, EPOLL_CTL_DEL, (int) user->ident, NULL);
+	close((int) user->ident);
+
+	return 0;
+}
+#endif
+
 /** Add a user callback to the event list.
  *
  * @param[in] el	Containing the timer events.
@@ -625,15 +1021,97 @@ int fr_event_timer_insert(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t
 uintptr_t fr_event_user_insert(fr_event_list_t *el, fr_event_user_handler_t callback, void *uctx)
 {
 	fr_event_user_t *user;
+#ifdef WITH_EVENT_EPOLL
+	int fd;
+	struct epoll_event ep;
+#else
+	struct kevent kev;
+#endif
 
 	user = talloc(el, fr_event_user_t);
+	if (unlikely(!user)) {
+		fr_strerror_printf("Out of memory");
+		return 0;
+	}
 	user->callback = callback;
 	user->uctx = uctx;
+
+#ifdef WITH_EVENT_EPOLL
+	/*
+	 *	The ident is the eventfd, so that other threads can
+	 *	signal us without looking anything up.
+	 */
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		fr_strerror_printf("Failed creating eventfd: %s", fr_syserror(errno));
+		talloc_free(user);
+		return 0;
+	}
+
+	memset(&ep, 0, sizeof(ep));
+	ep.events = EPOLLIN;
+	ep.data.ptr = (void *) ((uintptr_t) user | EVENT_EPOLL_USER);
+
+	if (epoll_ctl(el->kq, EPOLL_CTL_ADD, fd, &ep) < 0) {
+		fr_strerror_printf("Failed adding eventfd: %s", fr_syserror(errno));
+		close(fd);
+		talloc_free(user);
+		return 0;
+	}
+
+	user->ident = fd;
+	talloc_set_destructor(user, _event_user_free);
+#else
 	user->ident = (uintptr_t) user;
 
+	EV_SET(&kev, user->ident, EVFILT_USER, EV_ADD | EV_CLEAR, NOTE_FFNOP, 0, NULL);
+	if (kevent(el->kq, &kev, 1, NULL, 0, NULL) < 0) {
+		fr_strerror_printf("Failed adding user event to kqueue: %s", fr_syserror(errno));
+		talloc_free(user);
+		return 0;
+	}
+#endif
+
 	fr_dlist_insert_tail(&el->user_callbacks, &user->entry);
 
-	return user->ident;;
+	return user->ident;
+}
+
+/** Signal a user event
+ *
+ *  May be called from any thread.
+ *
+ * @param[in] kq	of the event list.  See #fr_event_list_kq.
+ * @param[in] ident	returned by #fr_event_user_insert.
+ * @return
+ *	- < 0 on error
+ *	- 0 on success
+ */
+int fr_event_user_trigger(int kq, uintptr_t ident)
+{
+#ifdef WITH_EVENT_EPOLL
+	uint64_t	one = 1;
+
+	/*
+	 *	EAGAIN means the counter is full, so the event is
+	 *	already pending.
+	 */
+	if ((write((int) ident, &one, sizeof(one)) < 0) && (errno != EAGAIN)) {
+		fr_strerror_printf("Failed signalling eventfd (%i): %s", (int) ident, fr_syserror(errno));
+		return -1;
+	}
+	(void) kq;
+#else
+	struct kevent	kev;
+
+	EV_SET(&kev, ident, EVFILT_USER, 0, NOTE_TRIGGER | NOTE_FFNOP, 0, NULL);
+	if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0) {
+		fr_strerror_printf("Failed sending user event to kqueue (%i): %s", kq, fr_syserror(errno));
+		return -1;
+	}
+#endif
+
+	return 0;
 }
 
 
@@ -799,16 +1277,18 @@ int fr_event_timer_run(fr_event_list_t *el, struct timeval *when)
 
 	if (unlikely(!el)) return 0;
 
-	if (fr_heap_num_elements(el->times) == 0) {
-		when->tv_sec = 0;
-		when->tv_usec = 0;
-		return 0;
-	}
+	/*
+	 *	Move any timers which are now due from the timing
+	 *	wheel into the heap.
+	 */
+	if (el->wheel_enabled) event_wheel_advance(el, when);
 
 	ev = fr_heap_peek(el->times);
 	if (!ev) {
-		when->tv_sec = 0;
-		when->tv_usec = 0;
+		if (!event_timer_next(el, when)) {
+			when->tv_sec = 0;
+			when->tv_usec = 0;
+		}
 		return 0;
 	}
 
@@ -818,7 +1298,7 @@ int fr_event_timer_run(fr_event_list_t *el, struct timeval *when)
 	if ((ev->when.tv_sec > when->tv_sec) ||
 	    ((ev->when.tv_sec == when->tv_sec) &&
 	     (ev->when.tv_usec > when->tv_usec))) {
-		*when = ev->when;
+		(void) event_timer_next(el, when);
 		return 0;
 	}
 
@@ -846,7 +1326,11 @@ int fr_event_timer_run(fr_event_list_t *el, struct timeval *when)
 int fr_event_corral(fr_event_list_t *el, bool wait)
 {
 	struct timeval		when, *wake;
+#ifdef WITH_EVENT_EPOLL
+	int			timeout;
+#else
 	struct timespec		ts_when, *ts_wake;
+#endif
 	fr_dlist_t		*entry;
 	int			num_fd_events;
 
@@ -866,22 +1350,16 @@ int fr_event_corral(fr_event_list_t *el, bool wait)
 	wake = &when;
 
 	if (wait) {
-		if (fr_heap_num_elements(el->times) > 0) {
-			fr_event_timer_t *ev;
-
-			ev = fr_heap_peek(el->times);
-			if (!fr_cond_assert(ev)) {
-				fr_strerror_printf("Timer heap says it is non-empty, but there are no entries in it");
-				return -1;
-			}
+		struct timeval next;
 
+		if (event_timer_next(el, &next)) {
 			gettimeofday(&el->now, NULL);
 
 			/*
 			 *	Next event is in the future, get the time
 			 *	between now and that event.
 			 */
-			if (fr_timeval_cmp(&ev->when, &el->now) > 0) fr_timeval_subtract(&when, &ev->when, &el->now);
+			if (fr_timeval_cmp(&next, &el->now) > 0) fr_timeval_subtract(&when, &next, &el->now);
 
 			wake = &when;
 		} else {
@@ -907,6 +1385,22 @@ int fr_event_corral(fr_event_list_t *el, bool wait)
 		}
 	}
 
+#ifdef WITH_EVENT_EPOLL
+	/*
+	 *	epoll_wait() takes milliseconds.  Round up, so that
+	 *	we don't wake up just before a timer is due, and then
+	 *	spin until it is.
+	 */
+	if (!wake) {
+		timeout = -1;
+	} else if (when.tv_sec >= (INT_MAX / 1000)) {
+		timeout = INT_MAX;
+	} else {
+		timeout = (when.tv_sec * 1000) + ((when.tv_usec + 999) / 1000);
+	}
+
+	num_fd_events = epoll_wait(el->kq, el->events, FR_EV_BATCH_FDS, timeout);
+#else
 	if (wake) {
 		ts_wake = &ts_when;
 		ts_when.tv_sec = when.tv_sec;
@@ -921,6 +1415,7 @@ int fr_event_corral(fr_event_list_t *el, bool wait)
 	 *	or wait for the next timer event.
 	 */
 	num_fd_events = kevent(el->kq, NULL, 0, el->events, FR_EV_BATCH_FDS, ts_wake);
+#endif
 
 	/*
 	 *	Interrupt is different from timeout / FD events.
@@ -937,18 +1432,123 @@ int fr_event_corral(fr_event_list_t *el, bool wait)
 	return el->num_fd_events = num_fd_events;
 }
 
+#ifdef WITH_EVENT_EPOLL
+/** Reset the counter of an eventfd
+ *
+ * @param[in] fd	the eventfd.
+ */
+static inline void event_epoll_clear(int fd)
+{
+	uint64_t	count;
+	ssize_t		rcode;
+
+	rcode = read(fd, &count, sizeof(count));
+	(void) rcode;
+}
+
+/** Service the file descriptor and user events returned by epoll_wait()
+ *
+ *  The callbacks are given the same flags as they would get from
+ *  kqueue, i.e. EV_EOF and EV_ERROR.
+ *
+ * @param[in] el containing events to service.
+ */
+static void event_epoll_service(fr_event_list_t *el)
+{
+	int		i;
+
+	for (i = 0; i < el->num_fd_events; i++) {
+		fr_event_fd_t	*ev;
+		int		fd_errno = 0;
+		int		flags = 0;
+		uint32_t	events = el->events[i].events;
+		uintptr_t	data = (uintptr_t) el->events[i].data.ptr;
+
+		/*
+		 *	This is just a "wakeup" event, which is always
+		 *	ignored.
+		 */
+		if (!data) {
+			event_epoll_clear(el->exit_fd);
+			continue;
+		}
+
+		/*
+		 *	Process any user events.
+		 */
+		if (data & EVENT_EPOLL_USER) {
+			fr_event_user_t *user;
+			struct kevent	kev;
+
+			user = talloc_get_type_abort((void *) (data & ~EVENT_EPOLL_USER), fr_event_user_t);
+
+			event_epoll_clear((int) user->ident);
+
+			EV_SET(&kev, user->ident, EVFILT_USER, 0, 0, 0, NULL);
+			user->callback(el->kq, &kev, user->uctx);
+			continue;
+		}
+
+		ev = talloc_get_type_abort((void *) data, fr_event_fd_t);
+
+		if (!fr_cond_assert(ev->is_registered)) continue;
+
+		if (unlikely(events & EPOLLERR)) {
+			socklen_t len = sizeof(fd_errno);
+
+			flags = EV_ERROR;
+			if (getsockopt(ev->fd, SOL_SOCKET, SO_ERROR, &fd_errno, &len) < 0) fd_errno = errno;
+
+		ev_error:
+			if (ev->error) ev->error(el, ev->fd, flags, fd_errno, ev->uctx);
+			fr_event_fd_delete(el, ev->fd);
+			continue;
+		}
+
+		/*
+		 *	The equivalent of kqueue's EV_EOF.
+		 */
+		if (events & (EPOLLHUP | EPOLLRDHUP)) {
+			flags = EV_EOF;
+
+			if (!ev->is_file) goto ev_error;
+		}
+
+		ev->in_handler = true;
+		if (ev->read && (events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP))) {
+			ev->read(el, ev->fd, flags, ev->uctx);
+		}
+		if (ev->write && (events & EPOLLOUT) && !ev->deferred_delete) {
+			ev->write(el, ev->fd, flags, ev->uctx);
+		}
+		ev->in_handler = false;
+
+		/*
+		 *	Process any deferred deletes performed
+		 *	by the I/O handler.
+		 */
+		if (ev->deferred_delete) fr_event_fd_delete(el, ev->fd);
+	}
+}
+#endif
+
 /** Service any outstanding timer or file descriptor events
  *
  * @param[in] el containing events to service.
  */
 void fr_event_service(fr_event_list_t *el)
 {
+#ifndef WITH_EVENT_EPOLL
 	int		i;
+#endif
 	fr_dlist_t	*entry;
 	struct timeval	when;
 
 	if (unlikely(el->exit)) return;
 
+#ifdef WITH_EVENT_EPOLL
+	event_epoll_service(el);
+#else
 	/*
 	 *	Run all of the file descriptor events.
 	 */
@@ -1042,13 +1642,14 @@ service:
 		 */
 		if (ev->deferred_delete) fr_event_fd_delete(el, ev->fd);
 	}
+#endif
 
 	gettimeofday(&el->now, NULL);
 
 	/*
 	 *	Run all of the timer events.
 	 */
-	if (fr_heap_num_elements(el->times) > 0) {
+	if (fr_event_list_num_elements(el) > 0) {
 		do {
 			when = el->now;
 		} while (fr_event_timer_run(el, &when) == 1);
@@ -1078,8 +1679,6 @@ service:
  */
 void fr_event_loop_exit(fr_event_list_t *el, int code)
 {
-	struct kevent kev;
-
 	if (unlikely(!el)) return;
 
 	el->exit = code;
@@ -1087,8 +1686,11 @@ void fr_event_loop_exit(fr_event_list_t *el, int code)
 	/*
 	 *	Signal the control plane to exit.
 	 */
-	EV_SET(&kev, 0, EVFILT_USER, 0, NOTE_TRIGGER | NOTE_FFNOP, 0, NULL);
-	(void) kevent(el->kq, &kev, 1, NULL, 0, NULL);
+#ifdef WITH_EVENT_EPOLL
+	(void) fr_event_user_trigger(el->kq, el->exit_fd);
+#else
+	(void) fr_event_user_trigger(el->kq, 0);
+#endif
 }
 
 /** Check to see whether the event loop is in the process of exiting
@@ -1129,11 +1731,26 @@ int fr_event_loop(fr_event_list_t *el)
 static int _event_list_free(fr_event_list_t *el)
 {
 	fr_event_timer_t const *ev;
+	int level, slot;
+
+	for (level = 0; level < EVENT_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < EVENT_WHEEL_SLOTS; slot++) {
+			fr_dlist_t *head = &el->wheel[level][slot];
+
+			while (head->next != head) {
+				ev = fr_ptr_to_type(fr_event_timer_t, entry, head->next);
+				fr_event_timer_delete(el, &ev);
+			}
+		}
+	}
 
 	while ((ev = fr_heap_peek(el->times)) != NULL) fr_event_timer_delete(el, &ev);
 
 	talloc_free(el->times);
 
+#ifdef WITH_EVENT_EPOLL
+	if (el->exit_fd >= 0) close(el->exit_fd);
+#endif
 	close(el->kq);
 
 	return 0;
@@ -1151,12 +1768,28 @@ static int _event_list_free(fr_event_list_t *el)
 fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_t status, void *status_uctx)
 {
 	fr_event_list_t *el;
+	int level, slot;
+#ifdef WITH_EVENT_EPOLL
+	struct epoll_event ep;
+#else
 	struct kevent kev;
+#endif
 
 	el = talloc_zero(ctx, fr_event_list_t);
 	if (!fr_cond_assert(el)) {
 		return NULL;
 	}
+#ifdef WITH_EVENT_EPOLL
+	el->exit_fd = -1;
+#endif
+
+	/*
+	 *	The destructor walks the timing wheel, so it has
+	 *	to be initialised first.
+	 */
+	for (level = 0; level < EVENT_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < EVENT_WHEEL_SLOTS; slot++) FR_DLIST_INIT(el->wheel[level][slot]);
+	}
 	talloc_set_destructor(el, _event_list_free);
 
 	el->times = fr_heap_create(fr_event_timer_cmp, offsetof(fr_event_timer_t, heap));
@@ -1166,7 +1799,11 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_t status,
 	}
 	el->fds = rbtree_create(el, fr_event_fd_cmp, NULL, 0);
 
+#ifdef WITH_EVENT_EPOLL
+	el->kq = epoll_create1(EPOLL_CLOEXEC);
+#else
 	el->kq = kqueue();
+#endif
 	if (el->kq < 0) {
 		talloc_free(el);
 		return NULL;
@@ -1178,6 +1815,24 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_t status,
 
 	if (status) (void) fr_event_pre_insert(el, status, status_uctx);
 
+#ifdef WITH_EVENT_EPOLL
+	/*
+	 *	Set our "exit" callback as NULL data.
+	 */
+	el->exit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (el->exit_fd < 0) {
+		talloc_free(el);
+		return NULL;
+	}
+
+	memset(&ep, 0, sizeof(ep));
+	ep.events = EPOLLIN;
+	ep.data.ptr = NULL;
+	if (epoll_ctl(el->kq, EPOLL_CTL_ADD, el->exit_fd, &ep) < 0) {
+		talloc_free(el);
+		return NULL;
+	}
+#else
 	/*
 	 *	Set our "exit" callback as ident 0.
 	 */
@@ -1186,6 +1841,7 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_t status,
 		talloc_free(el);
 		return NULL;
 	}
+#endif
 
 	return el;
 }
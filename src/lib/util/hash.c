@@ -18,15 +18,23 @@
  * @file lib/util/hash.c
  * @brief Resizable hash tables.
  *
- *  The weird "reverse" function is based on an idea from
- *  "Split-Ordered Lists - Lock-free Resizable Hash Tables", with
- *  modifications so that they're not lock-free. :(
+ *  An open addressing table, with the entries stored inline, in the
+ *  style of the "Swiss tables" from Abseil.  Each slot has a control
+ *  byte holding 7 bits of its hash, and the control bytes are probed a
+ *  group of 16 at a time.  With SSE2 that's one compare per group, so
+ *  most lookups touch one cache line of control bytes and call the
+ *  compare function once.
  *
- *  However, the split-order idea allows a fast & easy splitting of the
- *  hash bucket chain when the hash table is resized.  Without it, we'd
- *  have to check & update the pointers for every node in the buck chain,
- *  rather than being able to move 1/2 of the entries in the chain with
- *  one update.
+ *  There's no allocation per entry, and lookups never modify the
+ *  table.
+ *
+ *  Tables created with FR_HASH_TABLE_SPLIT use the previous
+ *  implementation instead.  That has a chain of entries per bucket,
+ *  kept in bit-reversed hash order, an idea from "Split-Ordered Lists
+ *  - Lock-free Resizable Hash Tables", with modifications so that
+ *  they're not lock-free. :(  Growing the table then only has to
+ *  double the bucket array.  Buckets are split from their parent
+ *  when they're first used, which can happen on a lookup.
  *
  * @copyright 2005,2006  The FreeRADIUS server project
  */
@@ -35,38 +43,272 @@ RCSID("$Id$")
 #include <freeradius-devel/libradius.h>
 
 /*
- *	A reasonable number of buckets to start off with.
- *	Should be a power of two.
+ *	Number of control bytes examined by each probe.  Groups start
+ *	at multiples of the group size, so a probe is a single 16 byte
+ *	load.
+ */
+#define FR_HASH_GROUP_SIZE (16)
+
+/*
+ *	A reasonable number of slots to start off with.
+ *	Should be a power of two, and a multiple of the group size.
+ */
+#define FR_HASH_NUM_SLOTS (64)
+
+/*
+ *	Values of the control byte for each slot.  A full slot
+ *	holds the bottom 7 bits of its (mixed) hash, so the top bit
+ *	is only set for slots which are free.
+ */
+#define FR_HASH_CTRL_EMPTY	(0x80)
+#define FR_HASH_CTRL_DELETED	(0xfe)
+
+/*
+ *	A reasonable number of buckets to start off a split-ordered
+ *	table with.  Should be a power of two.
  */
 #define FR_HASH_NUM_BUCKETS (64)
 
 typedef struct fr_hash_entry_t {
-	struct fr_hash_entry_t *next;
-	uint32_t	reversed;
 	uint32_t	key;
 	void const 	*data;
 } fr_hash_entry_t;
 
+/*
+ *	An entry in a split-ordered table.
+ */
+typedef struct fr_hash_node_t {
+	struct fr_hash_node_t *next;
+	uint32_t	reversed;
+	uint32_t	key;
+	void const 	*data;
+} fr_hash_node_t;
+
 
 struct fr_hash_table_t {
+	fr_hash_table_type_t	type;
 	int			num_elements;
-	int			num_buckets; /* power of 2 */
-	int			next_grow;
-	int			mask;
 
 	fr_hash_table_free_t	free;
 	fr_hash_table_hash_t	hash;
 	fr_hash_table_cmp_t	cmp;
 
-	fr_hash_entry_t	null;
+	/*
+	 *	FR_HASH_TABLE_OPEN
+	 */
+	int			num_deleted;	//!< Slots marked DELETED.
+	int			num_slots;	//!< Power of 2.
+	int			group_mask;	//!< Number of groups - 1.
+	int			max_used;	//!< Grow when elements + deleted reaches this.
+
+	uint8_t			*ctrl;		//!< One control byte per slot.
+	fr_hash_entry_t		*slots;
 
-	fr_hash_entry_t	**buckets;
+	/*
+	 *	FR_HASH_TABLE_SPLIT
+	 */
+	int			num_buckets;	//!< Power of 2.
+	int			next_grow;
+	int			mask;
+
+	fr_hash_node_t		null;
+	fr_hash_node_t		**buckets;
 };
 
-#ifdef TESTING
-static int grow = 0;
+/*
+ *	The user supplied hash functions aren't always great in the
+ *	low bits, and we use those to pick a group.  Run the key
+ *	through the murmur3 finalizer so every bit is mixed in.
+ */
+static inline uint32_t hash_mix(uint32_t key)
+{
+	key ^= key >> 16;
+	key *= 0x85ebca6b;
+	key ^= key >> 13;
+	key *= 0xc2b2ae35;
+	key ^= key >> 16;
+
+	return key;
+}
+
+#define H1(_mixed)	((_mixed) >> 7)
+#define H2(_mixed)	((uint8_t)((_mixed) & 0x7f))
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/*
+ *	Bitmask of the slots in the group whose control byte is "c".
+ */
+static inline uint32_t group_match(uint8_t const *group, uint8_t c)
+{
+	__m128i ctrl = _mm_loadu_si128((__m128i const *)group);
+
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)c)));
+}
+
+/*
+ *	Bitmask of the slots in the group which are EMPTY or DELETED.
+ */
+static inline uint32_t group_match_free(uint8_t const *group)
+{
+	return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((__m128i const *)group));
+}
+#else
+/*
+ *	Portable version, which works on the group 8 bytes at a time.
+ *
+ *	Turn the top bit of each byte of a word into a one bit per
+ *	slot mask.
+ */
+#define MSBS (0x8080808080808080ULL)
+#define LSBS (0x0101010101010101ULL)
+
+static inline uint32_t word_to_mask(uint64_t msbs)
+{
+	return (uint32_t)(((msbs >> 7) * 0x0102040810204080ULL) >> 56);
+}
+
+/*
+ *	Little endian load, so slot N is always byte N of the word.
+ *	Compilers turn this into a single load where they can.
+ */
+static inline uint64_t word_load(uint8_t const *p)
+{
+	return ((uint64_t)p[0]) | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+	       ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+/*
+ *	Bitmask of the slots in the group whose control byte is "c".
+ *
+ *	This may match bytes next to a real match, so callers have to
+ *	check the key anyway.  It's only used with EMPTY when the
+ *	result is being tested for zero, which is exact.
+ */
+static inline uint32_t group_match(uint8_t const *group, uint8_t c)
+{
+	uint64_t	lo = word_load(group) ^ (LSBS * c);
+	uint64_t	hi = word_load(group + 8) ^ (LSBS * c);
+
+	lo = (lo - LSBS) & ~lo & MSBS;
+	hi = (hi - LSBS) & ~hi & MSBS;
+
+	return word_to_mask(lo) | (word_to_mask(hi) << 8);
+}
+
+/*
+ *	Bitmask of the slots in the group which are EMPTY or DELETED.
+ */
+static inline uint32_t group_match_free(uint8_t const *group)
+{
+	return word_to_mask(word_load(group) & MSBS) | (word_to_mask(word_load(group + 8) & MSBS) << 8);
+}
 #endif
 
+/*
+ *	Triangular probing over a power of two number of groups
+ *	visits every group exactly once.
+ */
+#define PROBE_NEXT(_ht, _g, _i)	(((_g) + ++(_i)) & (_ht)->group_mask)
+
+/*
+ *	Find the slot holding data, or -1 if it isn't in the table.
+ */
+static int slot_find(fr_hash_table_t *ht, uint32_t key, void const *data)
+{
+	uint32_t	mixed = hash_mix(key);
+	uint32_t	g = H1(mixed) & ht->group_mask;
+	uint8_t		h2 = H2(mixed);
+	int		i = 0;
+
+	for (;;) {
+		uint8_t const	*group = ht->ctrl + (g * FR_HASH_GROUP_SIZE);
+		uint32_t	match;
+
+		for (match = group_match(group, h2); match; match &= match - 1) {
+			int slot = (g * FR_HASH_GROUP_SIZE) + __builtin_ctz(match);
+
+			if (ht->slots[slot].key != key) continue;
+			if (ht->cmp && (ht->cmp(data, ht->slots[slot].data) != 0)) continue;
+
+			return slot;
+		}
+
+		/*
+		 *	Deletions never make an EMPTY slot in a group
+		 *	which a later probe sequence passed through, so
+		 *	an EMPTY slot means we're done.
+		 */
+		if (group_match(group, FR_HASH_CTRL_EMPTY)) return -1;
+
+		if (i == ht->group_mask) return -1;
+		g = PROBE_NEXT(ht, g, i);
+	}
+}
+
+/*
+ *	Find the first EMPTY or DELETED slot on the probe sequence
+ *	for this key.  There is always one, as we grow before the
+ *	table fills.
+ */
+static int slot_find_free(fr_hash_table_t *ht, uint32_t mixed)
+{
+	uint32_t	g = H1(mixed) & ht->group_mask;
+	int		i = 0;
+
+	for (;;) {
+		uint32_t match = group_match_free(ht->ctrl + (g * FR_HASH_GROUP_SIZE));
+
+		if (match) return (g * FR_HASH_GROUP_SIZE) + __builtin_ctz(match);
+
+		g = PROBE_NEXT(ht, g, i);
+	}
+}
+
+/*
+ *	Allocate the slots and control bytes for a table of num_slots.
+ */
+static int slots_alloc(fr_hash_table_t *ht, int num_slots)
+{
+	fr_hash_entry_t	*slots;
+
+	/*
+	 *	One allocation, with the control bytes after the
+	 *	slots, so that the slots stay aligned.
+	 */
+	slots = talloc_size(ht, num_slots * (sizeof(fr_hash_entry_t) + 1));
+	if (!slots) return -1;
+	talloc_set_name_const(slots, "fr_hash_entry_t");
+
+	ht->slots = slots;
+	ht->ctrl = (uint8_t *)(slots + num_slots);
+	memset(ht->ctrl, FR_HASH_CTRL_EMPTY, num_slots);
+
+	ht->num_slots = num_slots;
+	ht->num_deleted = 0;
+	ht->group_mask = (num_slots / FR_HASH_GROUP_SIZE) - 1;
+
+	/*
+	 *	Have a maximum load factor of 7/8, counting deleted
+	 *	slots.  Probes only stop at a group with an empty
+	 *	slot, so above that the probe sequences get long.
+	 */
+	ht->max_used = num_slots - (num_slots >> 3);
+
+	return 0;
+}
+
+/*
+ *	Put an entry into a slot, without checking for duplicates.
+ */
+static inline void slot_set(fr_hash_table_t *ht, int slot, uint32_t mixed, uint32_t key, void const *data)
+{
+	ht->ctrl[slot] = H2(mixed);
+	ht->slots[slot].key = key;
+	ht->slots[slot].data = data;
+}
+
 /*
  * perl -e 'foreach $i (0..255) {$r = 0; foreach $j (0 .. 7 ) { if (($i & ( 1<< $j)) != 0) { $r |= (1 << (7 - $j));}} print $r, ", ";if (($i & 7) == 7) {print "\n";}}'
  */
@@ -174,12 +416,12 @@ static uint32_t parent_of(uint32_t key)
 }
 
 
-static fr_hash_entry_t *list_find(fr_hash_table_t *ht,
-				    fr_hash_entry_t *head,
-				    uint32_t reversed,
-				    void const *data)
+static fr_hash_node_t *list_find(fr_hash_table_t *ht,
+				   fr_hash_node_t *head,
+				   uint32_t reversed,
+				   void const *data)
 {
-	fr_hash_entry_t *cur;
+	fr_hash_node_t *cur;
 
 	for (cur = head; cur != &ht->null; cur = cur->next) {
 		if (cur->reversed == reversed) {
@@ -201,24 +443,33 @@ static fr_hash_entry_t *list_find(fr_hash_table_t *ht,
  *	Inserts a new entry into the list, in order.
  */
 static int list_insert(fr_hash_table_t *ht,
-		       fr_hash_entry_t **head, fr_hash_entry_t *node)
+		       fr_hash_node_t **head, fr_hash_node_t *node)
 {
-	fr_hash_entry_t **last, *cur;
+	fr_hash_node_t **last, *cur;
 
 	last = head;
 
 	for (cur = *head; cur != &ht->null; cur = cur->next) {
 		if (cur->reversed > node->reversed) break;
-		last = &(cur->next);
 
+		/*
+		 *	Entries with the same hash are in the order
+		 *	that list_find() expects, so we insert before
+		 *	the first one which compares greater.
+		 */
 		if (cur->reversed == node->reversed) {
 			if (ht->cmp) {
 				int cmp = ht->cmp(node->data, cur->data);
 				if (cmp > 0) break;
-				if (cmp < 0) continue;
+				if (cmp < 0) {
+					last = &(cur->next);
+					continue;
+				}
 			}
 			return 0;
 		}
+
+		last = &(cur->next);
 	}
 
 	node->next = *last;
@@ -232,9 +483,9 @@ static int list_insert(fr_hash_table_t *ht,
  *	Delete an entry from the list.
  */
 static int list_delete(fr_hash_table_t *ht,
-		       fr_hash_entry_t **head, fr_hash_entry_t *node)
+		       fr_hash_node_t **head, fr_hash_node_t *node)
 {
-	fr_hash_entry_t **last, *cur;
+	fr_hash_node_t **last, *cur;
 
 	last = head;
 
@@ -248,10 +499,10 @@ static int list_delete(fr_hash_table_t *ht,
 }
 
 
-static int _fr_hash_table_free(fr_hash_table_t *ht)
+static int _split_table_free(fr_hash_table_t *ht)
 {
 	int i;
-	fr_hash_entry_t *node, *next;
+	fr_hash_node_t *node, *next;
 
 	/*
 	 *	Walk over the buckets, freeing them all.
@@ -272,27 +523,12 @@ static int _fr_hash_table_free(fr_hash_table_t *ht)
 }
 
 /*
- *	Create the table.
+ *	Set up a split-ordered table.
  *
  *	Memory usage in bytes is (20/3) * number of entries.
  */
-fr_hash_table_t *fr_hash_table_create(TALLOC_CTX *ctx,
-				      fr_hash_table_hash_t hashNode,
-				      fr_hash_table_cmp_t cmpNode,
-				      fr_hash_table_free_t freeNode)
+static int split_init(fr_hash_table_t *ht)
 {
-	fr_hash_table_t *ht;
-
-	if (!hashNode) return NULL;
-
-	ht = talloc_zero(NULL, fr_hash_table_t);
-	if (!ht) return NULL;
-	talloc_set_destructor(ht, _fr_hash_table_free);
-	fr_talloc_link_ctx(ctx, ht);
-
-	ht->free = freeNode;
-	ht->hash = hashNode;
-	ht->cmp = cmpNode;
 	ht->num_buckets = FR_HASH_NUM_BUCKETS;
 	ht->mask = ht->num_buckets - 1;
 
@@ -303,20 +539,18 @@ fr_hash_table_t *fr_hash_table_create(TALLOC_CTX *ctx,
 	 */
 	ht->next_grow = (ht->num_buckets << 1) + (ht->num_buckets >> 1);
 
-	ht->buckets = talloc_zero_array(NULL, fr_hash_entry_t *, ht->num_buckets);
-	if (!ht->buckets) {
-		talloc_free(ht);
-		return NULL;
-	}
+	ht->buckets = talloc_zero_array(NULL, fr_hash_node_t *, ht->num_buckets);
+	if (!ht->buckets) return -1;
 
 	ht->null.reversed = ~0;
 	ht->null.key = ~0;
 	ht->null.next = &ht->null;
 	ht->buckets[0] = &ht->null;
 
-	return ht;
-}
+	talloc_set_destructor(ht, _split_table_free);
 
+	return 0;
+}
 
 /*
  *	If the current bucket is uninitialized, initialize it
@@ -328,10 +562,10 @@ fr_hash_table_t *fr_hash_table_create(TALLOC_CTX *ctx,
  *	wrong.  To solve that problem, we walk down the whole chain,
  *	inserting the elements into the correct place.
  */
-static void fr_hash_table_fixup(fr_hash_table_t *ht, uint32_t entry)
+static void split_fixup(fr_hash_table_t *ht, uint32_t entry)
 {
 	uint32_t parent_entry;
-	fr_hash_entry_t **last, *cur;
+	fr_hash_node_t **last, *cur;
 	uint32_t this;
 
 	parent_entry = parent_of(entry);
@@ -339,7 +573,7 @@ static void fr_hash_table_fixup(fr_hash_table_t *ht, uint32_t entry)
 	/* parent_entry == entry if and only if entry == 0 */
 
 	if (!ht->buckets[parent_entry]) {
-		fr_hash_table_fixup(ht, parent_entry);
+		split_fixup(ht, parent_entry);
 	}
 
 	/*
@@ -376,13 +610,13 @@ static void fr_hash_table_fixup(fr_hash_table_t *ht, uint32_t entry)
 #define GROW_FACTOR (2)
 
 /*
- *	Grow the hash table.
+ *	Grow a split-ordered table.
  */
-static void fr_hash_table_grow(fr_hash_table_t *ht)
+static void split_grow(fr_hash_table_t *ht)
 {
-	fr_hash_entry_t **buckets;
+	fr_hash_node_t **buckets;
 
-	buckets = talloc_zero_array(NULL, fr_hash_entry_t *, GROW_FACTOR * ht->num_buckets);
+	buckets = talloc_zero_array(NULL, fr_hash_node_t *, GROW_FACTOR * ht->num_buckets);
 	if (!buckets) return;
 
 	memcpy(buckets, ht->buckets, sizeof(*buckets) * ht->num_buckets);
@@ -392,36 +626,26 @@ static void fr_hash_table_grow(fr_hash_table_t *ht)
 	ht->num_buckets *= GROW_FACTOR;
 	ht->next_grow *= GROW_FACTOR;
 	ht->mask = ht->num_buckets - 1;
-#ifdef TESTING
-	grow = 1;
-	fprintf(stderr, "GROW TO %d\n", ht->num_buckets);
-#endif
 }
 
-
-/*
- *	Insert data.
- */
-int fr_hash_table_insert(fr_hash_table_t *ht, void const *data)
+static int split_insert(fr_hash_table_t *ht, void const *data)
 {
 	uint32_t key;
 	uint32_t entry;
 	uint32_t reversed;
-	fr_hash_entry_t *node;
-
-	if (!ht || !data) return 0;
+	fr_hash_node_t *node;
 
 	key = ht->hash(data);
 	entry = key & ht->mask;
 	reversed = reverse(key);
 
-	if (!ht->buckets[entry]) fr_hash_table_fixup(ht, entry);
+	if (!ht->buckets[entry]) split_fixup(ht, entry);
 
 	/*
 	 *	If we try to do our own memory allocation here, the
 	 *	speedup is only ~15% or so, which isn't worth it.
 	 */
-	node = talloc_zero(NULL, fr_hash_entry_t);
+	node = talloc_zero(NULL, fr_hash_node_t);
 	if (!node) return 0;
 
 	node->next = &ht->null;
@@ -440,51 +664,238 @@ int fr_hash_table_insert(fr_hash_table_t *ht, void const *data)
 	 *	necessary.
 	 */
 	ht->num_elements++;
-	if (ht->num_elements >= ht->next_grow) fr_hash_table_grow(ht);
+	if (ht->num_elements >= ht->next_grow) split_grow(ht);
 
 	return 1;
 }
 
-
-/*
- *	Internal find a node routine.
- */
-static fr_hash_entry_t *fr_hash_table_find(fr_hash_table_t *ht, void const *data)
+static fr_hash_node_t *split_find(fr_hash_table_t *ht, void const *data)
 {
 	uint32_t key;
 	uint32_t entry;
 	uint32_t reversed;
 
-	if (!ht) return NULL;
-
 	key = ht->hash(data);
 	entry = key & ht->mask;
 	reversed = reverse(key);
 
-	if (!ht->buckets[entry]) fr_hash_table_fixup(ht, entry);
+	if (!ht->buckets[entry]) split_fixup(ht, entry);
 
 	return list_find(ht, ht->buckets[entry], reversed, data);
 }
 
+static void *split_yank(fr_hash_table_t *ht, void const *data)
+{
+	uint32_t key;
+	uint32_t entry;
+	uint32_t reversed;
+	void *old;
+	fr_hash_node_t *node;
+
+	key = ht->hash(data);
+	entry = key & ht->mask;
+	reversed = reverse(key);
+
+	if (!ht->buckets[entry]) split_fixup(ht, entry);
+
+	node = list_find(ht, ht->buckets[entry], reversed, data);
+	if (!node) return NULL;
+
+	list_delete(ht, &ht->buckets[entry], node);
+	ht->num_elements--;
+
+	memcpy(&old, &node->data, sizeof(old));
+	talloc_free(node);
+
+	return old;
+}
+
+/*
+ *	Walk over the nodes, allowing deletes & inserts to happen.
+ */
+static int split_walk(fr_hash_table_t *ht, fr_hash_table_walk_t callback, void *context)
+{
+	int i, rcode;
+
+	for (i = ht->num_buckets - 1; i >= 0; i--) {
+		fr_hash_node_t *node, *next;
+
+		/*
+		 *	Ensure that the current bucket is filled.
+		 */
+		if (!ht->buckets[i]) split_fixup(ht, i);
+
+		for (node = ht->buckets[i]; node != &ht->null; node = next) {
+			void *arg;
+
+			next = node->next;
+
+			memcpy(&arg, &node->data, sizeof(arg));
+			rcode = callback(context, arg);
+
+			if (rcode != 0) return rcode;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *	Create a table of the given type.
+ *
+ *	Memory usage in bytes is between 19 and 34 per entry for
+ *	FR_HASH_TABLE_OPEN.
+ */
+fr_hash_table_t *fr_hash_table_create_type(TALLOC_CTX *ctx, fr_hash_table_type_t type,
+					   fr_hash_table_hash_t hashNode,
+					   fr_hash_table_cmp_t cmpNode,
+					   fr_hash_table_free_t freeNode)
+{
+	fr_hash_table_t *ht;
+	int rcode;
+
+	if (!hashNode) return NULL;
+
+	ht = talloc_zero(NULL, fr_hash_table_t);
+	if (!ht) return NULL;
+	fr_talloc_link_ctx(ctx, ht);
+
+	ht->type = type;
+	ht->free = freeNode;
+	ht->hash = hashNode;
+	ht->cmp = cmpNode;
+
+	switch (type) {
+	case FR_HASH_TABLE_OPEN:
+		rcode = slots_alloc(ht, FR_HASH_NUM_SLOTS);
+		break;
+
+	case FR_HASH_TABLE_SPLIT:
+		rcode = split_init(ht);
+		break;
+
+	default:
+		rcode = -1;
+		break;
+	}
+
+	if (rcode < 0) {
+		talloc_free(ht);
+		return NULL;
+	}
+
+	return ht;
+}
+
+/*
+ *	Create the default type of table.
+ */
+fr_hash_table_t *fr_hash_table_create(TALLOC_CTX *ctx,
+				      fr_hash_table_hash_t hashNode,
+				      fr_hash_table_cmp_t cmpNode,
+				      fr_hash_table_free_t freeNode)
+{
+	return fr_hash_table_create_type(ctx, FR_HASH_TABLE_OPEN, hashNode, cmpNode, freeNode);
+}
+
+/*
+ *	Re-insert every entry into a new set of slots.  This also
+ *	clears out all of the DELETED slots.
+ */
+static void fr_hash_table_grow(fr_hash_table_t *ht, int num_slots)
+{
+	fr_hash_entry_t	*old_slots = ht->slots;
+	uint8_t		*old_ctrl = ht->ctrl;
+	int		old_num_slots = ht->num_slots;
+	int		i;
+
+	if (slots_alloc(ht, num_slots) < 0) return;
+
+	for (i = 0; i < old_num_slots; i++) {
+		uint32_t mixed;
+
+		if (old_ctrl[i] & 0x80) continue;
+
+		mixed = hash_mix(old_slots[i].key);
+		slot_set(ht, slot_find_free(ht, mixed), mixed, old_slots[i].key, old_slots[i].data);
+	}
+	talloc_free(old_slots);	/* Also frees the old control bytes */
+}
+
+/*
+ *	Insert data.
+ */
+int fr_hash_table_insert(fr_hash_table_t *ht, void const *data)
+{
+	uint32_t	key, mixed;
+	int		slot;
+
+	if (!ht || !data) return 0;
+
+	if (ht->type == FR_HASH_TABLE_SPLIT) return split_insert(ht, data);
+
+	key = ht->hash(data);
+
+	/* already in the table, can't insert it */
+	if (slot_find(ht, key, data) >= 0) return 0;
+
+	mixed = hash_mix(key);
+	slot = slot_find_free(ht, mixed);
+
+	if (ht->ctrl[slot] == FR_HASH_CTRL_DELETED) {
+		ht->num_deleted--;
+
+	/*
+	 *	Check the load factor, and grow the table if
+	 *	necessary.  If most of the used slots are DELETED
+	 *	rather than full, rehashing at the same size is
+	 *	enough.
+	 */
+	} else if ((ht->num_elements + ht->num_deleted + 1) > ht->max_used) {
+		fr_hash_table_grow(ht, (ht->num_elements >= (ht->max_used >> 1)) ?
+				   ht->num_slots * 2 : ht->num_slots);
+		slot = slot_find_free(ht, mixed);
+	}
+
+	slot_set(ht, slot, mixed, key, data);
+	ht->num_elements++;
+
+	return 1;
+}
 
 /*
  *	Replace old data with new data, OR insert if there is no old.
  */
 int fr_hash_table_replace(fr_hash_table_t *ht, void const *data)
 {
-	fr_hash_entry_t *node;
-	void *tofree;
+	int	slot;
+	void	*tofree;
 
 	if (!ht || !data) return 0;
 
-	node = fr_hash_table_find(ht, data);
-	if (!node) return fr_hash_table_insert(ht, data);
+	if (ht->type == FR_HASH_TABLE_SPLIT) {
+		fr_hash_node_t *node;
+
+		node = split_find(ht, data);
+		if (!node) return fr_hash_table_insert(ht, data);
+
+		if (ht->free) {
+			memcpy(&tofree, &node->data, sizeof(tofree));
+			ht->free(tofree);
+		}
+		node->data = data;
+
+		return 1;
+	}
+
+	slot = slot_find(ht, ht->hash(data), data);
+	if (slot < 0) return fr_hash_table_insert(ht, data);
 
 	if (ht->free) {
-		memcpy(&tofree, &node->data, sizeof(tofree));
+		memcpy(&tofree, &ht->slots[slot].data, sizeof(tofree));
 		ht->free(tofree);
 	}
-	node->data = data;
+	ht->slots[slot].data = data;
 
 	return 1;
 }
@@ -492,16 +903,33 @@ int fr_hash_table_replace(fr_hash_table_t *ht, void const *data)
 
 /*
  *	Find data from a template
+ *
+ *	Lookups don't modify FR_HASH_TABLE_OPEN tables, so they're
+ *	safe to do at the same time from multiple threads, provided
+ *	nothing is inserting or deleting.
  */
 void *fr_hash_table_finddata(fr_hash_table_t *ht, void const *data)
 {
-	fr_hash_entry_t *node;
-	void *out;
+	int	slot;
+	void	*out;
 
-	node = fr_hash_table_find(ht, data);
-	if (!node) return NULL;
+	if (!ht) return NULL;
 
-	memcpy(&out, &node->data, sizeof(out));
+	if (ht->type == FR_HASH_TABLE_SPLIT) {
+		fr_hash_node_t *node;
+
+		node = split_find(ht, data);
+		if (!node) return NULL;
+
+		memcpy(&out, &node->data, sizeof(out));
+
+		return out;
+	}
+
+	slot = slot_find(ht, ht->hash(data), data);
+	if (slot < 0) return NULL;
+
+	memcpy(&out, &ht->slots[slot].data, sizeof(out));
 
 	return out;
 }
@@ -513,29 +941,34 @@ void *fr_hash_table_finddata(fr_hash_table_t *ht, void const *data)
  */
 void *fr_hash_table_yank(fr_hash_table_t *ht, void const *data)
 {
-	uint32_t key;
-	uint32_t entry;
-	uint32_t reversed;
-	void *old;
-	fr_hash_entry_t *node;
+	int		slot;
+	void		*old;
+	uint8_t const	*group;
 
 	if (!ht) return NULL;
 
-	key = ht->hash(data);
-	entry = key & ht->mask;
-	reversed = reverse(key);
+	if (ht->type == FR_HASH_TABLE_SPLIT) return split_yank(ht, data);
 
-	if (!ht->buckets[entry]) fr_hash_table_fixup(ht, entry);
+	slot = slot_find(ht, ht->hash(data), data);
+	if (slot < 0) return NULL;
 
-	node = list_find(ht, ht->buckets[entry], reversed, data);
-	if (!node) return NULL;
+	memcpy(&old, &ht->slots[slot].data, sizeof(old));
 
-	list_delete(ht, &ht->buckets[entry], node);
+	/*
+	 *	If the group already has an EMPTY slot, no probe
+	 *	sequence continues past it, so this slot can be
+	 *	EMPTY too.  Otherwise other entries may be behind
+	 *	it, and it has to be marked DELETED.
+	 */
+	group = ht->ctrl + (slot & ~(FR_HASH_GROUP_SIZE - 1));
+	if (group_match(group, FR_HASH_CTRL_EMPTY)) {
+		ht->ctrl[slot] = FR_HASH_CTRL_EMPTY;
+	} else {
+		ht->ctrl[slot] = FR_HASH_CTRL_DELETED;
+		ht->num_deleted++;
+	}
 	ht->num_elements--;
 
-	memcpy(&old, &node->data, sizeof(old));
-	talloc_free(node);
-
 	return old;
 }
 
@@ -562,31 +995,38 @@ int fr_hash_table_delete(fr_hash_table_t *ht, void const *data)
 void fr_hash_table_free(fr_hash_table_t *ht)
 {
 	int i;
-	fr_hash_entry_t *node, *next;
 
 	if (!ht) return;
 
-	/*
-	 *	Walk over the buckets, freeing them all.
-	 */
-	if (ht->free) {
+	if (ht->free && (ht->type == FR_HASH_TABLE_SPLIT)) {
 		for (i = 0; i < ht->num_buckets; i++) {
+			fr_hash_node_t *node;
+
 			if (ht->buckets[i]) for (node = ht->buckets[i];
 						 node != &ht->null;
-						 node = next) {
+						 node = node->next) {
 				void *tofree;
 
-				next = node->next;
 				if (!node->data) continue; /* dummy entry */
 
 				memcpy(&tofree, &node->data, sizeof(tofree));
 				ht->free(tofree);
 			}
 		}
+
+	} else if (ht->free) {
+		for (i = 0; i < ht->num_slots; i++) {
+			void *tofree;
+
+			if (ht->ctrl[i] & 0x80) continue;
+
+			memcpy(&tofree, &ht->slots[i].data, sizeof(tofree));
+			ht->free(tofree);
+		}
 	}
 
 	/*
-	 *	Also frees nodes and buckets
+	 *	Also frees the slots, or the nodes and buckets
 	 */
 	talloc_free(ht);
 }
@@ -604,7 +1044,11 @@ int fr_hash_table_num_elements(fr_hash_table_t *ht)
 
 
 /*
- *	Walk over the nodes, allowing deletes & inserts to happen.
+ *	Walk over the nodes, allowing deletes to happen.
+ *
+ *	Inserts from the callback into an FR_HASH_TABLE_OPEN table may
+ *	cause it to grow, in which case some entries may be visited
+ *	twice, or not at all.
  */
 int fr_hash_table_walk(fr_hash_table_t *ht,
 		       fr_hash_table_walk_t callback,
@@ -614,24 +1058,17 @@ int fr_hash_table_walk(fr_hash_table_t *ht,
 
 	if (!ht || !callback) return 0;
 
-	for (i = ht->num_buckets - 1; i >= 0; i--) {
-		fr_hash_entry_t *node, *next;
+	if (ht->type == FR_HASH_TABLE_SPLIT) return split_walk(ht, callback, context);
 
-		/*
-		 *	Ensure that the current bucket is filled.
-		 */
-		if (!ht->buckets[i]) fr_hash_table_fixup(ht, i);
+	for (i = ht->num_slots - 1; i >= 0; i--) {
+		void *arg;
 
-		for (node = ht->buckets[i]; node != &ht->null; node = next) {
-			void *arg;
-
-			next = node->next;
+		if (ht->ctrl[i] & 0x80) continue;
 
-			memcpy(&arg, &node->data, sizeof(arg));
-			rcode = callback(context, arg);
+		memcpy(&arg, &ht->slots[i].data, sizeof(arg));
+		rcode = callback(context, arg);
 
-			if (rcode != 0) return rcode;
-		}
+		if (rcode != 0) return rcode;
 	}
 
 	return 0;
@@ -644,69 +1081,53 @@ int fr_hash_table_walk(fr_hash_table_t *ht,
  */
 int fr_hash_table_info(fr_hash_table_t *ht)
 {
-	int i, a, collisions, uninitialized;
+	int i, collisions, probes;
 	int array[256];
 
 	if (!ht) return 0;
 
-	uninitialized = collisions = 0;
+	if (ht->type == FR_HASH_TABLE_SPLIT) {
+		printf("HASH TABLE %p\tsplit-ordered\tbuckets: %d\tentries: %d\n\n", ht,
+		       ht->num_buckets, ht->num_elements);
+		return 0;
+	}
+
+	collisions = probes = 0;
 	memset(array, 0, sizeof(array));
 
-	for (i = 0; i < ht->num_buckets; i++) {
-		uint32_t key;
-		int load;
-		fr_hash_entry_t *node, *next;
+	/*
+	 *	For each entry, count how many groups a lookup has to
+	 *	examine before it finds it.
+	 */
+	for (i = 0; i < ht->num_slots; i++) {
+		uint32_t	mixed, g;
+		int		j = 0, load;
 
-		/*
-		 *	If we haven't inserted or looked up an entry
-		 *	in a bucket, it's uninitialized.
-		 */
-		if (!ht->buckets[i]) {
-			uninitialized++;
-			continue;
-		}
+		if (ht->ctrl[i] & 0x80) continue;
 
-		load = 0;
-		key = ~0;
-		for (node = ht->buckets[i]; node != &ht->null; node = next) {
-			if (node->reversed == key) {
-				collisions++;
-			} else {
-				key = node->reversed;
-			}
-			next = node->next;
-			load++;
-		}
+		mixed = hash_mix(ht->slots[i].key);
+		g = H1(mixed) & ht->group_mask;
+		for (load = 1; g != (uint32_t)(i / FR_HASH_GROUP_SIZE); load++) g = PROBE_NEXT(ht, g, j);
+
+		if (load > 1) collisions++;
+		probes += load;
 
 		if (load > 255) load = 255;
 		array[load]++;
 	}
 
-	printf("HASH TABLE %p\tbuckets: %d\t(%d uninitialized)\n", ht,
-		ht->num_buckets, uninitialized);
-	printf("\tnum entries %d\thash collisions %d\n",
+	printf("HASH TABLE %p\tslots: %d\t(%d deleted)\n", ht,
+		ht->num_slots, ht->num_deleted);
+	printf("\tnum entries %d\tdisplaced entries %d\n",
 		ht->num_elements, collisions);
 
-	a = 0;
 	for (i = 1; i < 256; i++) {
 		if (!array[i]) continue;
 		printf("%d\t%d\n", i, array[i]);
-
-		/*
-		 *	Since the entries are ordered, the lookup cost
-		 *	for any one element in a chain is (on average)
-		 *	the cost of walking half of the chain.
-		 */
-		if (i > 1) {
-			a += array[i] * i;
-		}
 	}
-	a /= 2;
-	a += array[1];
 
-	printf("\texpected lookup cost = %d/%d or %f\n\n",
-	       ht->num_elements, a,
-	       (float) ht->num_elements / (float) a);
+	printf("\texpected lookup cost = %f groups\n\n",
+	       ht->num_elements ? (float) probes / (float) ht->num_elements : 0);
 
 	return 0;
 }
@@ -33,19 +33,18 @@ RCSID("$Id$")
 #include <freeradius-devel/libradius.h>
 #include <freeradius-devel/md5.h>
 
-/** Calculate HMAC using MD5
+/** Precompute the HMAC-MD5 state for a key
  *
- * @param digest Caller digest to be filled in.
- * @param text Pointer to data stream.
- * @param text_len length of data stream.
- * @param key Pointer to authentication key.
- * @param key_len Length of authentication key.
+ * The first block of both the inner and outer hashes depends only on the key,
+ * so when the same key is used for many messages, those blocks only need to
+ * be hashed once.
  *
+ * @param[out] hmac_key to initialise.
+ * @param[in] key Pointer to authentication key.
+ * @param[in] key_len Length of authentication key.
  */
-void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
-		 uint8_t const *key, size_t key_len)
+void fr_hmac_md5_key_init(fr_hmac_md5_key_t *hmac_key, uint8_t const *key, size_t key_len)
 {
-	FR_MD5_CTX context;
 	uint8_t k_ipad[65];    /* inner padding - key XORd with ipad */
 	uint8_t k_opad[65];    /* outer padding - key XORd with opad */
 	uint8_t tk[16];
@@ -86,25 +85,59 @@ void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t
 		k_ipad[i] ^= 0x36;
 		k_opad[i] ^= 0x5c;
 	}
+
+	fr_md5_init(&hmac_key->inner);
+	fr_md5_update(&hmac_key->inner, k_ipad, 64);	/* start with inner pad */
+
+	fr_md5_init(&hmac_key->outer);
+	fr_md5_update(&hmac_key->outer, k_opad, 64);	/* start with outer pad */
+}
+
+/** Calculate HMAC using MD5, with a precomputed key
+ *
+ * @param digest Caller digest to be filled in.
+ * @param text Pointer to data stream.
+ * @param text_len length of data stream.
+ * @param hmac_key from fr_hmac_md5_key_init().
+ */
+void fr_hmac_md5_precomputed(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
+			     fr_hmac_md5_key_t const *hmac_key)
+{
+	FR_MD5_CTX context;
+
 	/*
 	 * perform inner MD5
 	 */
-	fr_md5_init(&context);		   /* init context for 1st
-					      * pass */
-	fr_md5_update(&context, k_ipad, 64);      /* start with inner pad */
+	fr_md5_copy(&context, &hmac_key->inner);
 	fr_md5_update(&context, text, text_len); /* then text of datagram */
 	fr_md5_final(digest, &context);	  /* finish up 1st pass */
 	/*
 	 * perform outer MD5
 	 */
-	fr_md5_init(&context);		   /* init context for 2nd
-					      * pass */
-	fr_md5_update(&context, k_opad, 64);     /* start with outer pad */
+	fr_md5_copy(&context, &hmac_key->outer);
 	fr_md5_update(&context, digest, 16);     /* then results of 1st
 					      * hash */
 	fr_md5_final(digest, &context);	  /* finish up 2nd pass */
 }
 
+/** Calculate HMAC using MD5
+ *
+ * @param digest Caller digest to be filled in.
+ * @param text Pointer to data stream.
+ * @param text_len length of data stream.
+ * @param key Pointer to authentication key.
+ * @param key_len Length of authentication key.
+ *
+ */
+void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
+		 uint8_t const *key, size_t key_len)
+{
+	fr_hmac_md5_key_t hmac_key;
+
+	fr_hmac_md5_key_init(&hmac_key, key, key_len);
+	fr_hmac_md5_precomputed(digest, text, text_len, &hmac_key);
+}
+
 /*
 Test Vectors (Trailing '\0' of a character string not included in test):
 
@@ -361,6 +361,8 @@ int fr_vlog(fr_log_t const *log, fr_log_type_t type, char const *msg, va_list ap
 			type = LOG_ERR;
 			break;
 		}
+		if (fr_log_async_write(log, type, NULL, buffer, strlen(buffer)) >= 0) break;
+
 		syslog(type, "%s", buffer);
 		break;
 #endif
@@ -368,7 +370,14 @@ int fr_vlog(fr_log_t const *log, fr_log_type_t type, char const *msg, va_list ap
 	case L_DST_FILES:
 	case L_DST_STDOUT:
 	case L_DST_STDERR:
+	{
+		ssize_t slen;
+
+		slen = fr_log_async_write(log, 0, NULL, buffer, strlen(buffer));
+		if (slen >= 0) return slen;
+
 		return write(log->fd, buffer, strlen(buffer));
+	}
 
 	default:
 	case L_DST_NULL:	/* should have been caught above */
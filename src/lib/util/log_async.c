@@ -0,0 +1,585 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/util/log_async.c
+ * @brief Write log messages from a dedicated thread.
+ *
+ * Each thread which logs has its own ring buffer, with one producer
+ * (the thread) and one consumer (the writer thread).  Formatted
+ * messages are copied into the ring without taking any locks.  The
+ * writer thread empties the rings, and writes consecutive messages for
+ * the same destination with one writev().
+ *
+ * When a ring is full, the message is either dropped and counted, or
+ * the thread waits for the writer to make room.
+ *
+ * Messages from one thread are written in order.  Messages from
+ * different threads may be interleaved differently from the order in
+ * which they were logged.
+ *
+ * @copyright 2026  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_SYSLOG_H
+#  include <syslog.h>
+#endif
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#define LOG_ENTRY_ALIGN		32	//!< Entries start on this boundary, so a pad entry always fits.
+#define LOG_MAX_IOV		64	//!< Messages written with one writev().
+#define LOG_IDLE_WAIT		100	//!< Milliseconds the writer sleeps for when there's nothing to do.
+
+/** The header of a message in a ring
+ *
+ * Followed by the filename (if any), including its trailing '\\0', and then the message.
+ */
+typedef struct {
+	uint32_t		len;		//!< Of the whole entry, including padding.
+	int			priority;	//!< For syslog.
+	fr_log_t const		*log;		//!< Destination.  NULL for padding at the end of the ring.
+	uint16_t		file_len;	//!< Length of the filename, or 0 for log->fd / syslog.
+	uint32_t		msg_len;	//!< Length of the message.
+} fr_log_entry_t;
+
+/** A ring of messages from one thread
+ *
+ * "head" and "tail" only ever increase.  The offset in "data" is the
+ * position modulo "size", which is a power of 2.
+ */
+typedef struct fr_log_ring_s fr_log_ring_t;
+struct fr_log_ring_s {
+	_Atomic(uint64_t)	head;		//!< Written by the thread which logs.
+	_Atomic(uint64_t)	tail;		//!< Written by the writer thread.
+
+	_Atomic(uint64_t)	dropped;	//!< Messages which didn't fit.
+	_Atomic(uint64_t)	blocked;	//!< Times we waited for room.
+	uint64_t		reported;	//!< Of "dropped", how many the writer has logged.
+
+	_Atomic(bool)		done;		//!< The thread has exited.
+
+	size_t			size;		//!< Of "data".
+	uint8_t			*data;
+
+	fr_log_ring_t		*next;		//!< In the list of all rings.
+};
+
+static pthread_mutex_t		log_async_mutex = PTHREAD_MUTEX_INITIALIZER;	//!< Protects "log_rings", and wakes the writer.
+static pthread_cond_t		log_async_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t		log_async_thread;
+
+static fr_log_ring_t		*log_rings = NULL;		//!< Every thread's ring.
+
+static _Atomic(bool)		log_async_running = false;	//!< Messages go to the rings.
+static _Atomic(bool)		log_async_stopping = false;	//!< The writer should drain, and exit.
+static _Atomic(bool)		log_async_sleeping = false;	//!< The writer is waiting on log_async_cond.
+
+static size_t			log_async_ring_size;
+static bool			log_async_block;
+
+static _Atomic(uint64_t)	log_async_written = 0;
+static _Atomic(uint64_t)	log_async_dropped = 0;		//!< From rings which have been freed.
+static _Atomic(uint64_t)	log_async_blocked = 0;		//!< From rings which have been freed.
+
+fr_thread_local_setup(fr_log_ring_t *, log_async_ring)	/* macro */
+
+/** Called when a thread which has logged exits
+ *
+ * The writer frees the ring once it's empty.
+ */
+static void _log_async_ring_done(void *arg)
+{
+	fr_log_ring_t *ring = arg;
+
+	/*
+	 *	Anything logged by later destructors goes into a new
+	 *	ring.
+	 */
+	log_async_ring = NULL;
+
+	atomic_store(&ring->done, true);
+}
+
+/** Get this thread's ring, creating it if necessary
+ *
+ */
+static fr_log_ring_t *log_async_ring_get(void)
+{
+	fr_log_ring_t *ring;
+
+	ring = log_async_ring;
+	if (ring) return ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring) return NULL;
+
+	ring->size = log_async_ring_size;
+	ring->data = malloc(ring->size);
+	if (!ring->data) {
+		free(ring);
+		return NULL;
+	}
+
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->dropped, 0);
+	atomic_init(&ring->blocked, 0);
+	atomic_init(&ring->done, false);
+
+	pthread_mutex_lock(&log_async_mutex);
+	ring->next = log_rings;
+	log_rings = ring;
+	pthread_mutex_unlock(&log_async_mutex);
+
+	fr_thread_local_set_destructor(log_async_ring, _log_async_ring_done, ring);
+
+	return ring;
+}
+
+/** Wake the writer thread, if it's waiting
+ *
+ */
+static void log_async_wake(void)
+{
+	if (!atomic_load(&log_async_sleeping)) return;
+
+	pthread_mutex_lock(&log_async_mutex);
+	pthread_cond_signal(&log_async_cond);
+	pthread_mutex_unlock(&log_async_mutex);
+}
+
+/** Whether messages are being written by the writer thread
+ *
+ */
+bool fr_log_async_enabled(void)
+{
+	return atomic_load_explicit(&log_async_running, memory_order_relaxed);
+}
+
+/** Queue a formatted message for the writer thread
+ *
+ * @param[in] log	destination.
+ * @param[in] priority	for syslog.
+ * @param[in] file	to append the message to, instead of log->fd.  May be NULL.
+ * @param[in] msg	to write, including any trailing newline.
+ * @param[in] msg_len	length of msg.
+ * @return
+ *	- msg_len if the message was queued.
+ *	- 0 if it was dropped.
+ *	- -1 if asynchronous logging isn't running, or there's no ring
+ *	  for this thread.  The caller should write the message itself.
+ */
+ssize_t fr_log_async_write(fr_log_t const *log, int priority, char const *file, char const *msg, size_t msg_len)
+{
+	fr_log_ring_t	*ring;
+	fr_log_entry_t	*entry;
+	size_t		file_len = 0, need, room, offset;
+	uint64_t	head, tail;
+
+	if (!fr_log_async_enabled()) return -1;
+
+	ring = log_async_ring_get();
+	if (!ring) return -1;
+
+	if (file) file_len = strlen(file) + 1;
+	if (file_len > UINT16_MAX) return -1;
+
+	/*
+	 *	Very long messages are truncated, so that they always
+	 *	fit into an empty ring.
+	 */
+	if ((sizeof(*entry) + file_len + msg_len) > (ring->size / 2)) {
+		if ((sizeof(*entry) + file_len) >= (ring->size / 2)) return -1;
+		msg_len = (ring->size / 2) - sizeof(*entry) - file_len;
+	}
+
+	need = sizeof(*entry) + file_len + msg_len;
+	need = (need + (LOG_ENTRY_ALIGN - 1)) & ~((size_t) LOG_ENTRY_ALIGN - 1);
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	for (;;) {
+		tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+		offset = head & (ring->size - 1);
+		room = ring->size - offset;	/* until the end of the ring */
+
+		/*
+		 *	If the message doesn't fit before the end of
+		 *	the ring, we pad to the end, and start again
+		 *	at the beginning.
+		 */
+		if ((ring->size - (head - tail)) >= (need + ((room < need) ? room : 0))) break;
+
+		if (!log_async_block) {
+			atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+			return 0;
+		}
+
+		/*
+		 *	The writer is going away, and won't make room.
+		 */
+		if (!fr_log_async_enabled()) return -1;
+
+		atomic_fetch_add_explicit(&ring->blocked, 1, memory_order_relaxed);
+		log_async_wake();
+		usleep(1000);
+	}
+
+	if (room < need) {
+		entry = (fr_log_entry_t *) (ring->data + offset);
+		entry->len = room;
+		entry->log = NULL;
+		head += room;
+		offset = 0;
+	}
+
+	entry = (fr_log_entry_t *) (ring->data + offset);
+	entry->len = need;
+	entry->priority = priority;
+	entry->log = log;
+	entry->file_len = file_len;
+	entry->msg_len = msg_len;
+	if (file_len) memcpy(ring->data + offset + sizeof(*entry), file, file_len);
+	memcpy(ring->data + offset + sizeof(*entry) + file_len, msg, msg_len);
+
+	atomic_store_explicit(&ring->head, head + need, memory_order_seq_cst);
+
+	log_async_wake();
+
+	return msg_len;
+}
+
+/** Where the writer sends messages
+ *
+ */
+typedef struct {
+	int		fd;		//!< Currently being written to.
+	char const	*file;		//!< If we opened "fd".
+	struct iovec	iov[LOG_MAX_IOV];
+	int		num;
+} fr_log_writer_t;
+
+static void log_writer_flush(fr_log_writer_t *w)
+{
+	if (!w->num) return;
+
+	if (w->fd >= 0) (void) fr_writev(w->fd, w->iov, w->num, NULL);
+
+	atomic_fetch_add_explicit(&log_async_written, w->num, memory_order_relaxed);
+	w->num = 0;
+}
+
+static void log_writer_close(fr_log_writer_t *w)
+{
+	log_writer_flush(w);
+
+	if (w->file) {
+		if (w->fd >= 0) close(w->fd);
+		w->file = NULL;
+	}
+	w->fd = -1;
+}
+
+/** Add a message to the current batch, starting a new batch if the destination changed
+ *
+ */
+static void log_writer_add(fr_log_writer_t *w, fr_log_entry_t const *entry)
+{
+	char const *file = NULL, *msg;
+
+	if (entry->file_len) file = (char const *) (entry + 1);
+	msg = (char const *) (entry + 1) + entry->file_len;
+
+#ifdef HAVE_SYSLOG_H
+	if (!file && (entry->log->dst == L_DST_SYSLOG)) {
+		log_writer_flush(w);
+		syslog(entry->priority, "%.*s", (int) entry->msg_len, msg);
+		atomic_fetch_add_explicit(&log_async_written, 1, memory_order_relaxed);
+		return;
+	}
+#endif
+
+	if (file) {
+		if (!w->file || (strcmp(w->file, file) != 0)) {
+			log_writer_close(w);
+			w->fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0666);
+			w->file = file;
+		}
+	} else if (w->file || (w->fd != entry->log->fd)) {
+		log_writer_close(w);
+		w->fd = entry->log->fd;
+	}
+
+	if (w->num == LOG_MAX_IOV) log_writer_flush(w);
+
+	memcpy(&w->iov[w->num].iov_base, &msg, sizeof(msg)); /* const issues */
+	w->iov[w->num].iov_len = entry->msg_len;
+	w->num++;
+}
+
+/** Write everything which is in one ring
+ *
+ * @return the number of messages written.
+ */
+static int log_writer_drain(fr_log_writer_t *w, fr_log_ring_t *ring)
+{
+	uint64_t	head, tail;
+	int		count = 0;
+	uint64_t	dropped;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	while (tail < head) {
+		fr_log_entry_t const *entry = (fr_log_entry_t const *) (ring->data + (tail & (ring->size - 1)));
+
+		if (entry->log) {
+			log_writer_add(w, entry);
+			count++;
+		}
+		tail += entry->len;
+	}
+
+	/*
+	 *	The iovecs point into the ring, so they have to be
+	 *	written before the thread can re-use the space.
+	 */
+	log_writer_close(w);
+	atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+	dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+	if (dropped != ring->reported) {
+		char	buffer[128];
+		size_t	len;
+
+		len = snprintf(buffer, sizeof(buffer), "Dropped %" PRIu64 " log messages, as the log ring was full\n",
+			       dropped - ring->reported);
+		ring->reported = dropped;
+
+		if (default_log.dst == L_DST_SYSLOG) {
+#ifdef HAVE_SYSLOG_H
+			syslog(LOG_WARNING, "%s", buffer);
+#endif
+		} else if (default_log.fd >= 0) {
+			if (write(default_log.fd, buffer, len) < 0) { /* nothing */ }
+		}
+	}
+
+	return count;
+}
+
+/** Drain every ring, and free the rings of threads which have exited
+ *
+ * @return the number of messages written.
+ */
+static int log_writer_drain_all(fr_log_writer_t *w)
+{
+	fr_log_ring_t	*ring, *next, **last;
+	int		count = 0;
+
+	pthread_mutex_lock(&log_async_mutex);
+	ring = log_rings;
+	pthread_mutex_unlock(&log_async_mutex);
+
+	/*
+	 *	New rings are only ever added at the head of the
+	 *	list, so we can walk it without the mutex.
+	 */
+	for (; ring; ring = ring->next) count += log_writer_drain(w, ring);
+
+	/*
+	 *	Free the rings of threads which have gone away.
+	 *	Their last messages were drained above, as "done" is
+	 *	set after the last message is written.
+	 */
+	pthread_mutex_lock(&log_async_mutex);
+	last = &log_rings;
+	for (ring = log_rings; ring; ring = next) {
+		next = ring->next;
+
+		if (!atomic_load(&ring->done) ||
+		    (atomic_load(&ring->tail) != atomic_load(&ring->head))) {
+			last = &ring->next;
+			continue;
+		}
+
+		*last = next;
+		atomic_fetch_add(&log_async_dropped, atomic_load(&ring->dropped));
+		atomic_fetch_add(&log_async_blocked, atomic_load(&ring->blocked));
+		free(ring->data);
+		free(ring);
+	}
+	pthread_mutex_unlock(&log_async_mutex);
+
+	return count;
+}
+
+/** Whether any ring has messages
+ *
+ */
+static bool log_async_pending(void)
+{
+	fr_log_ring_t *ring;
+
+	for (ring = log_rings; ring; ring = ring->next) {
+		if (atomic_load(&ring->head) != atomic_load(&ring->tail)) return true;
+	}
+
+	return false;
+}
+
+static void *log_async_writer(UNUSED void *arg)
+{
+	fr_log_writer_t w = { .fd = -1 };
+
+	for (;;) {
+		struct timespec	when;
+		struct timeval	now;
+
+		if (log_writer_drain_all(&w) > 0) continue;
+
+		if (atomic_load(&log_async_stopping)) break;
+
+		/*
+		 *	Nothing to do.  Sleep until a thread wakes us
+		 *	up, or for a short while in case we miss the
+		 *	wake up.
+		 */
+		gettimeofday(&now, NULL);
+		when.tv_sec = now.tv_sec;
+		when.tv_nsec = (now.tv_usec * 1000) + (LOG_IDLE_WAIT * 1000000);
+		if (when.tv_nsec >= 1000000000) {
+			when.tv_sec++;
+			when.tv_nsec -= 1000000000;
+		}
+
+		pthread_mutex_lock(&log_async_mutex);
+		atomic_store(&log_async_sleeping, true);
+		if (!log_async_pending() && !atomic_load(&log_async_stopping)) {
+			(void) pthread_cond_timedwait(&log_async_cond, &log_async_mutex, &when);
+		}
+		atomic_store(&log_async_sleeping, false);
+		pthread_mutex_unlock(&log_async_mutex);
+	}
+
+	/*
+	 *	One last pass, for anything logged while we were
+	 *	stopping.
+	 */
+	(void) log_writer_drain_all(&w);
+
+	return NULL;
+}
+
+/** Start writing log messages from a dedicated thread
+ *
+ * Must be called after the server has forked, as the thread doesn't
+ * survive fork().
+ *
+ * @param[in] ring_size	of each thread's ring, in bytes.  Rounded up to a power of 2.
+ * @param[in] block	when a ring is full.  If false, messages are dropped.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_log_async_start(size_t ring_size, bool block)
+{
+	size_t size = 4096;
+
+	if (fr_log_async_enabled()) return 0;
+
+	while (size < ring_size) size <<= 1;
+
+	log_async_ring_size = size;
+	log_async_block = block;
+	atomic_store(&log_async_stopping, false);
+
+	if (pthread_create(&log_async_thread, NULL, log_async_writer, NULL) != 0) {
+		fr_strerror_printf("Failed creating log writer thread: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	atomic_store(&log_async_running, true);
+
+	return 0;
+}
+
+/** Write any queued messages, and stop the writer thread
+ *
+ * Messages logged after this are written by the thread which logs them.
+ */
+void fr_log_async_stop(void)
+{
+	fr_log_writer_t w = { .fd = -1 };
+
+	if (!fr_log_async_enabled()) return;
+
+	atomic_store(&log_async_running, false);
+	atomic_store(&log_async_stopping, true);
+
+	pthread_mutex_lock(&log_async_mutex);
+	pthread_cond_signal(&log_async_cond);
+	pthread_mutex_unlock(&log_async_mutex);
+
+	pthread_join(log_async_thread, NULL);
+
+	/*
+	 *	Threads which started logging before we stopped the
+	 *	writer may have queued a few more messages.
+	 */
+	(void) log_writer_drain_all(&w);
+}
+
+/** Get the counters for asynchronous logging
+ *
+ * @param[out] stats	to fill in.
+ */
+void fr_log_async_stats(fr_log_async_stats_t *stats)
+{
+	fr_log_ring_t *ring;
+
+	memset(stats, 0, sizeof(*stats));
+
+	stats->running = fr_log_async_enabled();
+	stats->ring_size = log_async_ring_size;
+	stats->written = atomic_load(&log_async_written);
+	stats->dropped = atomic_load(&log_async_dropped);
+	stats->blocked = atomic_load(&log_async_blocked);
+
+	pthread_mutex_lock(&log_async_mutex);
+	for (ring = log_rings; ring; ring = ring->next) {
+		stats->rings++;
+		stats->queued += atomic_load(&ring->head) - atomic_load(&ring->tail);
+		stats->dropped += atomic_load(&ring->dropped);
+		stats->blocked += atomic_load(&ring->blocked);
+	}
+	pthread_mutex_unlock(&log_async_mutex);
+}
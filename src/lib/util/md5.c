@@ -34,6 +34,21 @@ void fr_md5_calc(uint8_t *out, uint8_t const *in, size_t inlen)
 	fr_md5_final(out, &ctx);
 }
 
+/*
+ *	The four core functions - F1 is optimized somewhat.
+ *
+ *	These are also used by the multi-buffer code, which is built
+ *	even when OpenSSL provides the scalar functions.  They work
+ *	equally well on vectors of uint32_t.
+ */
+#define F1(x, y, z) (z ^ (x & (y ^ z)))
+#define F2(x, y, z) F1(z, x, y)
+#define F3(x, y, z) (x ^ y ^ z)
+#define F4(x, y, z) (y ^ (x | ~z))
+
+/* This is the central step in the MD5 algorithm. */
+#define MD5STEP(f, w, x, y, z, data, s) (w += f(x, y, z) + data, w = w << s | w >> (32 - s),  w += x)
+
 #ifndef HAVE_OPENSSL_EVP_H
 /*
  * This code implements the MD5 message-digest algorithm.
@@ -166,15 +181,6 @@ void fr_md5_final(uint8_t out[MD5_DIGEST_LENGTH], FR_MD5_CTX *ctx)
 	memset(ctx, 0, sizeof(*ctx));	/* in case it's sensitive */
 }
 
-/* The four core functions - F1 is optimized somewhat */
-#define F1(x, y, z) (z ^ (x & (y ^ z)))
-#define F2(x, y, z) F1(z, x, y)
-#define F3(x, y, z) (x ^ y ^ z)
-#define F4(x, y, z) (y ^ (x | ~z))
-
-/* This is the central step in the MD5 algorithm. */
-#define MD5STEP(f, w, x, y, z, data, s) (w += f(x, y, z) + data, w = w << s | w >> (32 - s),  w += x)
-
 /** The core of the MD5 algorithm
  *
  * This alters an existing MD5 hash to reflect the addition of 16
@@ -275,3 +281,344 @@ void fr_md5_transform(uint32_t state[4], uint8_t const block[MD5_BLOCK_LENGTH])
 	state[3] += d;
 }
 #endif
+
+/*
+ *	Multi-buffer MD5.
+ *
+ *	MD5 can't be parallelised within one message, as each step
+ *	depends on the one before it.  It can be parallelised across
+ *	messages.  We run MD5_MULTI_LANES independent messages through
+ *	the rounds at once, with one message in each lane of a vector.
+ *	When a message finishes, the next one is loaded into its lane,
+ *	so messages of different lengths don't leave lanes idle.
+ *
+ *	The vectors use the GCC / clang vector extensions, so the
+ *	same code is compiled once for the baseline instruction set,
+ *	and once more for AVX2, which is chosen at run time.
+ */
+#ifdef __GNUC__
+#  define MD5_MULTI_LANES 8
+
+typedef uint32_t md5_vec_t __attribute__ ((vector_size (MD5_MULTI_LANES * sizeof(uint32_t))));
+
+/** The message being hashed in one lane
+ *
+ */
+typedef struct {
+	fr_md5_multi_t const	*msg;			//!< Message, or NULL if the lane is idle.
+	uint64_t		len;			//!< Total length of the message segments.
+	uint64_t		absorbed;		//!< Bytes absorbed by the starting context.
+	uint64_t		offset;			//!< Where the next block starts.
+	uint64_t		blocks;			//!< Blocks left to process, including padding.
+} md5_lane_t;
+
+/** Get the next block of a message, including any padding
+ *
+ * @param[out] block	to write.
+ * @param[in] lane	holding the message.
+ */
+static inline void md5_multi_block(uint8_t block[MD5_BLOCK_LENGTH], md5_lane_t const *lane)
+{
+	fr_md5_multi_t const	*msg = lane->msg;
+	uint64_t		start = 0, pos = lane->offset;
+	size_t			used = 0;
+	int			i;
+
+	for (i = 0; i < 2; i++) {
+		uint64_t end = start + msg->inlen[i];
+
+		if ((pos < end) && (used < MD5_BLOCK_LENGTH)) {
+			size_t len = end - pos;
+
+			if (len > (MD5_BLOCK_LENGTH - used)) len = MD5_BLOCK_LENGTH - used;
+
+			memcpy(block + used, msg->in[i] + (pos - start), len);
+			used += len;
+			pos += len;
+		}
+		start = end;
+	}
+
+	if (used == MD5_BLOCK_LENGTH) return;
+
+	memset(block + used, 0, MD5_BLOCK_LENGTH - used);
+
+	/*
+	 *	The 0x80 marker goes immediately after the data, which
+	 *	may be in this block, or in the previous one.
+	 */
+	if ((lane->len >= lane->offset) && (lane->len < (lane->offset + MD5_BLOCK_LENGTH))) {
+		block[lane->len - lane->offset] = 0x80;
+	}
+
+	/*
+	 *	The last block ends with the message length in bits.
+	 */
+	if (lane->blocks == 1) {
+		uint64_t bits = (lane->absorbed + lane->len) << 3;
+
+		for (i = 0; i < 8; i++) block[56 + i] = bits >> (i * 8);
+	}
+}
+
+/** Get the state, and the number of bytes absorbed, from an MD5 context
+ *
+ */
+static inline void md5_multi_ctx(uint32_t state[4], uint64_t *absorbed, FR_MD5_CTX const *ctx)
+{
+#ifdef HAVE_OPENSSL_EVP_H
+	state[0] = ctx->A;
+	state[1] = ctx->B;
+	state[2] = ctx->C;
+	state[3] = ctx->D;
+	*absorbed = ((((uint64_t) ctx->Nh) << 32) | ctx->Nl) >> 3;
+#else
+	memcpy(state, ctx->state, sizeof(ctx->state));
+	*absorbed = ((((uint64_t) ctx->count[1]) << 32) | ctx->count[0]) >> 3;
+#endif
+}
+
+/** MD5 transform across all lanes
+ *
+ * @param[in,out] state	Digest state for each lane.
+ * @param[in] in	One block for each lane, as little endian words.
+ */
+static inline __attribute__ ((always_inline)) void md5_multi_transform(md5_vec_t state[4], md5_vec_t const in[16])
+{
+	md5_vec_t a, b, c, d;
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+
+	MD5STEP(F1, a, b, c, d, in[ 0] + 0xd76aa478,  7);
+	MD5STEP(F1, d, a, b, c, in[ 1] + 0xe8c7b756, 12);
+	MD5STEP(F1, c, d, a, b, in[ 2] + 0x242070db, 17);
+	MD5STEP(F1, b, c, d, a, in[ 3] + 0xc1bdceee, 22);
+	MD5STEP(F1, a, b, c, d, in[ 4] + 0xf57c0faf,  7);
+	MD5STEP(F1, d, a, b, c, in[ 5] + 0x4787c62a, 12);
+	MD5STEP(F1, c, d, a, b, in[ 6] + 0xa8304613, 17);
+	MD5STEP(F1, b, c, d, a, in[ 7] + 0xfd469501, 22);
+	MD5STEP(F1, a, b, c, d, in[ 8] + 0x698098d8,  7);
+	MD5STEP(F1, d, a, b, c, in[ 9] + 0x8b44f7af, 12);
+	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
+	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
+	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122,  7);
+	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
+	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
+	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
+
+	MD5STEP(F2, a, b, c, d, in[ 1] + 0xf61e2562,  5);
+	MD5STEP(F2, d, a, b, c, in[ 6] + 0xc040b340,  9);
+	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
+	MD5STEP(F2, b, c, d, a, in[ 0] + 0xe9b6c7aa, 20);
+	MD5STEP(F2, a, b, c, d, in[ 5] + 0xd62f105d,  5);
+	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453,  9);
+	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
+	MD5STEP(F2, b, c, d, a, in[ 4] + 0xe7d3fbc8, 20);
+	MD5STEP(F2, a, b, c, d, in[ 9] + 0x21e1cde6,  5);
+	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6,  9);
+	MD5STEP(F2, c, d, a, b, in[ 3] + 0xf4d50d87, 14);
+	MD5STEP(F2, b, c, d, a, in[ 8] + 0x455a14ed, 20);
+	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905,  5);
+	MD5STEP(F2, d, a, b, c, in[ 2] + 0xfcefa3f8,  9);
+	MD5STEP(F2, c, d, a, b, in[ 7] + 0x676f02d9, 14);
+	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+
+	MD5STEP(F3, a, b, c, d, in[ 5] + 0xfffa3942,  4);
+	MD5STEP(F3, d, a, b, c, in[ 8] + 0x8771f681, 11);
+	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
+	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
+	MD5STEP(F3, a, b, c, d, in[ 1] + 0xa4beea44,  4);
+	MD5STEP(F3, d, a, b, c, in[ 4] + 0x4bdecfa9, 11);
+	MD5STEP(F3, c, d, a, b, in[ 7] + 0xf6bb4b60, 16);
+	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
+	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6,  4);
+	MD5STEP(F3, d, a, b, c, in[ 0] + 0xeaa127fa, 11);
+	MD5STEP(F3, c, d, a, b, in[ 3] + 0xd4ef3085, 16);
+	MD5STEP(F3, b, c, d, a, in[ 6] + 0x04881d05, 23);
+	MD5STEP(F3, a, b, c, d, in[ 9] + 0xd9d4d039,  4);
+	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
+	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
+	MD5STEP(F3, b, c, d, a, in[2 ] + 0xc4ac5665, 23);
+
+	MD5STEP(F4, a, b, c, d, in[ 0] + 0xf4292244,  6);
+	MD5STEP(F4, d, a, b, c, in[7 ] + 0x432aff97, 10);
+	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
+	MD5STEP(F4, b, c, d, a, in[5 ] + 0xfc93a039, 21);
+	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3,  6);
+	MD5STEP(F4, d, a, b, c, in[3 ] + 0x8f0ccc92, 10);
+	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
+	MD5STEP(F4, b, c, d, a, in[1 ] + 0x85845dd1, 21);
+	MD5STEP(F4, a, b, c, d, in[8 ] + 0x6fa87e4f,  6);
+	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
+	MD5STEP(F4, c, d, a, b, in[6 ] + 0xa3014314, 15);
+	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
+	MD5STEP(F4, a, b, c, d, in[4 ] + 0xf7537e82,  6);
+	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
+	MD5STEP(F4, c, d, a, b, in[2 ] + 0x2ad7d2bb, 15);
+	MD5STEP(F4, b, c, d, a, in[9 ] + 0xeb86d391, 21);
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+/** Hash messages, MD5_MULTI_LANES at a time
+ *
+ * This is inlined into each of the per-instruction set functions
+ * below, so that the vector code is generated for that instruction set.
+ */
+static inline __attribute__ ((always_inline)) void md5_multi(fr_md5_multi_t const *msg, int num)
+{
+	md5_lane_t	lane[MD5_MULTI_LANES];
+	md5_vec_t	state[4], in[16];
+	uint8_t		block[MD5_BLOCK_LENGTH];
+	int		i, j, next = 0, active = 0;
+
+	memset(lane, 0, sizeof(lane));
+	memset(state, 0, sizeof(state));
+
+	for (;;) {
+		/*
+		 *	Load new messages into any idle lanes.
+		 */
+		for (i = 0; (i < MD5_MULTI_LANES) && (next < num); i++) {
+			if (lane[i].msg) continue;
+
+			lane[i].msg = &msg[next++];
+			lane[i].len = lane[i].msg->inlen[0] + lane[i].msg->inlen[1];
+			lane[i].offset = 0;
+			lane[i].blocks = ((lane[i].len + 8) / MD5_BLOCK_LENGTH) + 1;
+
+			if (lane[i].msg->ctx) {
+				uint32_t initial[4];
+
+				md5_multi_ctx(initial, &lane[i].absorbed, lane[i].msg->ctx);
+				for (j = 0; j < 4; j++) state[j][i] = initial[j];
+			} else {
+				lane[i].absorbed = 0;
+				state[0][i] = 0x67452301;
+				state[1][i] = 0xefcdab89;
+				state[2][i] = 0x98badcfe;
+				state[3][i] = 0x10325476;
+			}
+			active++;
+		}
+
+		if (!active) break;
+
+		/*
+		 *	Transpose one block from each message into
+		 *	the vectors.  Idle lanes get hashed too, but
+		 *	their results are never used.
+		 */
+		for (i = 0; i < MD5_MULTI_LANES; i++) {
+			if (!lane[i].msg) {
+				for (j = 0; j < 16; j++) in[j][i] = 0;
+				continue;
+			}
+
+			md5_multi_block(block, &lane[i]);
+
+			for (j = 0; j < 16; j++) {
+				in[j][i] = (uint32_t)(
+				    (uint32_t)(block[j * 4 + 0]) |
+				    (uint32_t)(block[j * 4 + 1]) <<  8 |
+				    (uint32_t)(block[j * 4 + 2]) << 16 |
+				    (uint32_t)(block[j * 4 + 3]) << 24);
+			}
+		}
+
+		md5_multi_transform(state, in);
+
+		/*
+		 *	Write out the digests of any messages which
+		 *	are done.
+		 */
+		for (i = 0; i < MD5_MULTI_LANES; i++) {
+			if (!lane[i].msg) continue;
+
+			lane[i].offset += MD5_BLOCK_LENGTH;
+			if (--lane[i].blocks > 0) continue;
+
+			for (j = 0; j < 4; j++) {
+				uint32_t	word = state[j][i];
+				uint8_t		*out = lane[i].msg->out + (j * 4);
+
+				out[0] = word;
+				out[1] = word >> 8;
+				out[2] = word >> 16;
+				out[3] = word >> 24;
+			}
+
+			lane[i].msg = NULL;
+			active--;
+		}
+	}
+}
+
+static void md5_multi_generic(fr_md5_multi_t const *msg, int num)
+{
+	md5_multi(msg, num);
+}
+
+#  if defined(__x86_64__) || defined(__i386__)
+#    define HAVE_MD5_MULTI_AVX2
+static __attribute__ ((target ("avx2"))) void md5_multi_avx2(fr_md5_multi_t const *msg, int num)
+{
+	md5_multi(msg, num);
+}
+#  endif
+#endif	/* __GNUC__ */
+
+/** Calculate the MD5 hashes of multiple independent messages
+ *
+ * Where the compiler supports it, the messages are hashed in parallel, with
+ * one message per vector lane.  AVX2 is used if the CPU supports it.
+ * Otherwise the messages are hashed one at a time.
+ *
+ * Each message is the concatenation of its two segments, which lets callers
+ * hash "data + secret", or "pad + data", without copying the data first.
+ * A message may also continue from a context which has already absorbed
+ * whole blocks, such as the state from fr_hmac_md5_key_init().
+ *
+ * @param[in] msg	Array of messages to hash.
+ * @param[in] num	Number of messages.
+ */
+void fr_md5_calc_multi(fr_md5_multi_t const *msg, int num)
+{
+	int i;
+
+#ifdef __GNUC__
+	/*
+	 *	There's no point in using the vectors for one
+	 *	message, the other lanes would be wasted.
+	 */
+	if (num > 1) {
+#  ifdef HAVE_MD5_MULTI_AVX2
+		if (__builtin_cpu_supports("avx2")) {
+			md5_multi_avx2(msg, num);
+			return;
+		}
+#  endif
+		md5_multi_generic(msg, num);
+		return;
+	}
+#endif
+
+	for (i = 0; i < num; i++) {
+		FR_MD5_CTX ctx;
+
+		if (msg[i].ctx) {
+			fr_md5_copy(&ctx, msg[i].ctx);
+		} else {
+			fr_md5_init(&ctx);
+		}
+		fr_md5_update(&ctx, msg[i].in[0], msg[i].inlen[0]);
+		fr_md5_update(&ctx, msg[i].in[1], msg[i].inlen[1]);
+		fr_md5_final(msg[i].out, &ctx);
+	}
+}
@@ -253,6 +253,54 @@ int rad_unlockfd(int fd, int lock_len)
 
 static char const hextab[] = "0123456789abcdef";
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/*
+ *	Convert 16 hex digits to 8 bytes.  Returns false, and writes
+ *	nothing, if any of them isn't a hex digit.
+ *
+ *	Bytes with the top bit set are negative, so the signed compares
+ *	reject them.
+ */
+static inline bool hex2bin_sse2(uint8_t *bin, uint8_t const *hex)
+{
+	__m128i c = _mm_loadu_si128((__m128i const *)hex);
+	__m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+				      _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+				      _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+	__m128i val;
+
+	if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xffff) return false;
+
+	val = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+			   _mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+
+	/*
+	 *	Each 16 bit lane has the high nibble in its low byte,
+	 *	and the low nibble in its high byte.
+	 */
+	val = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(val, _mm_set1_epi16(0x00ff)), 4),
+			   _mm_srli_epi16(val, 8));
+	_mm_storel_epi64((__m128i *)bin, _mm_packus_epi16(val, _mm_setzero_si128()));
+
+	return true;
+}
+#endif
+
+/*
+ *	The value of each hex digit, plus one.  0 for anything which
+ *	isn't a hex digit.
+ */
+static uint8_t const hexval[UINT8_MAX + 1] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
 /** Convert hex strings to binary data
  *
  * @param bin Buffer to write output to.
@@ -265,7 +313,7 @@ size_t fr_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen)
 {
 	size_t i;
 	size_t len;
-	char *c1, *c2;
+	uint8_t const *p = (uint8_t const *) hex;
 
 	/*
 	 *	Smartly truncate output, caller should check number of bytes
@@ -274,11 +322,18 @@ size_t fr_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen)
 	len = inlen >> 1;
 	if (len > outlen) len = outlen;
 
-	for (i = 0; i < len; i++) {
-		if(!(c1 = memchr(hextab, tolower((int) hex[i << 1]), sizeof(hextab))) ||
-		   !(c2 = memchr(hextab, tolower((int) hex[(i << 1) + 1]), sizeof(hextab))))
-			break;
-		bin[i] = ((c1-hextab)<<4) + (c2-hextab);
+	i = 0;
+#ifdef __SSE2__
+	while (((len - i) >= 8) && hex2bin_sse2(bin + i, p + (i << 1))) i += 8;
+#endif
+
+	for (; i < len; i++) {
+		uint8_t c1 = hexval[p[i << 1]];
+		uint8_t c2 = hexval[p[(i << 1) + 1]];
+
+		if (!c1 || !c2) break;
+
+		bin[i] = ((c1 - 1) << 4) | (c2 - 1);
 	}
 
 	return i;
@@ -233,9 +233,10 @@ VALUE_PAIR *fr_pair_copy(TALLOC_CTX *ctx, VALUE_PAIR const *vp)
 	 */
 	if (n->da->flags.is_unknown) {
 		n->da = fr_dict_unknown_acopy(n, n->da);
-		if (!n->da) talloc_free(n);
-
-		return NULL;
+		if (!n->da) {
+			talloc_free(n);
+			return NULL;
+		}
 	}
 	n->next = NULL;
 
@@ -614,15 +615,30 @@ int fr_pair_mark_xlat(VALUE_PAIR *vp, char const *value)
 
 /** Find the pair with the matching DAs
  *
+ * This is called for every attribute reference in policies, so walk
+ * the list directly instead of setting up a cursor.  If the tag
+ * doesn't matter, matching is a pointer comparison.
  */
 VALUE_PAIR *fr_pair_find_by_da(VALUE_PAIR *head, fr_dict_attr_t const *da, int8_t tag)
 {
-	vp_cursor_t 	cursor;
+	VALUE_PAIR	*vp;
 
 	if(!fr_cond_assert(da)) return NULL;
 
-	(void) fr_pair_cursor_init(&cursor, &head);
-	return fr_pair_cursor_next_by_da(&cursor, da, tag);
+	if (!da->flags.has_tag || (tag == TAG_ANY)) {
+		for (vp = head; vp != NULL; vp = vp->next) {
+			VERIFY_VP(vp);
+			if (vp->da == da) return vp;
+		}
+		return NULL;
+	}
+
+	for (vp = head; vp != NULL; vp = vp->next) {
+		VERIFY_VP(vp);
+		if ((vp->da == da) && TAG_EQ(tag, vp->tag)) return vp;
+	}
+
+	return NULL;
 }
 
 
@@ -855,7 +871,7 @@ int8_t fr_pair_cmp_by_da_tag(void const *a, void const *b)
 	VALUE_PAIR const *my_a = a;
 	VALUE_PAIR const *my_b = b;
 
-	uint8_t cmp;
+	int8_t cmp;
 
 	VERIFY_VP(my_a);
 	VERIFY_VP(my_b);
@@ -1067,62 +1083,6 @@ int fr_pair_list_cmp(VALUE_PAIR *a, VALUE_PAIR *b)
 	return 1;
 }
 
-static void _pair_list_sort_split(VALUE_PAIR *source, VALUE_PAIR **front, VALUE_PAIR **back)
-{
-	VALUE_PAIR *fast;
-	VALUE_PAIR *slow;
-
-	/*
-	 *	Stopping condition - no more elements left to split
-	 */
-	if (!source || !source->next) {
-		*front = source;
-		*back = NULL;
-
-		return;
-	}
-
-	/*
-	 *	Fast advances twice as fast as slow, so when it gets to the end,
-	 *	slow will point to the middle of the linked list.
-	 */
-	slow = source;
-	fast = source->next;
-
-	while (fast) {
-		fast = fast->next;
-		if (fast) {
-			slow = slow->next;
-			fast = fast->next;
-		}
-	}
-
-	*front = source;
-	*back = slow->next;
-	slow->next = NULL;
-}
-
-static VALUE_PAIR *_pair_list_sort_merge(VALUE_PAIR *a, VALUE_PAIR *b, fr_cmp_t cmp)
-{
-	VALUE_PAIR *result = NULL;
-
-	if (!a) return b;
-	if (!b) return a;
-
-	/*
-	 *	Compare the fr_dict_attr_ts and tags
-	 */
-	if (cmp(a, b) <= 0) {
-		result = a;
-		result->next = _pair_list_sort_merge(a->next, b, cmp);
-	} else {
-		result = b;
-		result->next = _pair_list_sort_merge(a, b->next, cmp);
-	}
-
-	return result;
-}
-
 /** Sort a linked list of VALUE_PAIRs using merge sort
  *
  * @note We use a merge sort (which is a stable sort), making this
@@ -1130,28 +1090,84 @@ static VALUE_PAIR *_pair_list_sort_merge(VALUE_PAIR *a, VALUE_PAIR *b, fr_cmp_t
  *	fragments where the order of EAP-Message attributes needs to
  *	be maintained.
  *
+ * The sort is done bottom up, merging runs of 1, 2, 4... pairs in
+ * place, so it needs no extra memory and doesn't recurse.  Lists which
+ * are already in order (the common case for encoders) are detected in
+ * a single pass, and left alone.
+ *
  * @param[in,out] vps List of VALUE_PAIRs to sort.
  * @param[in] cmp to sort with
  */
 void fr_pair_list_sort(VALUE_PAIR **vps, fr_cmp_t cmp)
 {
-	VALUE_PAIR *head = *vps;
-	VALUE_PAIR *a;
-	VALUE_PAIR *b;
+	VALUE_PAIR	*head = *vps;
+	VALUE_PAIR	*p, *q, *e, *tail;
+	int		insize, nmerges, psize, qsize, i;
 
 	/*
 	 *	If there's 0-1 elements it must already be sorted.
 	 */
 	if (!head || !head->next) return;
 
-	_pair_list_sort_split(head, &a, &b);	/* Split into sublists */
-	fr_pair_list_sort(&a, cmp);		/* Traverse left */
-	fr_pair_list_sort(&b, cmp);		/* Traverse right */
+	for (p = head; p->next; p = p->next) if (cmp(p, p->next) > 0) break;
+	if (!p->next) return;
 
-	/*
-	 *	merge the two sorted lists together
-	 */
-	*vps = _pair_list_sort_merge(a, b, cmp);
+	for (insize = 1; ; insize *= 2) {
+		p = head;
+		head = tail = NULL;
+		nmerges = 0;
+
+		while (p) {
+			nmerges++;
+
+			/*
+			 *	Step q forward by up to insize pairs,
+			 *	to find the start of the second run.
+			 */
+			q = p;
+			psize = 0;
+			for (i = 0; (i < insize) && q; i++) {
+				psize++;
+				q = q->next;
+			}
+			qsize = insize;
+
+			/*
+			 *	Merge the two runs.  Taking from p
+			 *	when they're equal keeps the sort
+			 *	stable.
+			 */
+			while ((psize > 0) || ((qsize > 0) && q)) {
+				if (psize == 0) {
+					e = q;
+					q = q->next;
+					qsize--;
+				} else if ((qsize == 0) || !q || (cmp(p, q) <= 0)) {
+					e = p;
+					p = p->next;
+					psize--;
+				} else {
+					e = q;
+					q = q->next;
+					qsize--;
+				}
+
+				if (tail) {
+					tail->next = e;
+				} else {
+					head = e;
+				}
+				tail = e;
+			}
+
+			p = q;
+		}
+		tail->next = NULL;
+
+		if (nmerges <= 1) break;
+	}
+
+	*vps = head;
 }
 
 /** Write an error to the library errorbuff detailing the mismatch
@@ -1483,6 +1499,10 @@ error:
  *
  * Copy all pairs from 'from' regardless of tag, attribute or vendor.
  *
+ * @note This is a deep copy, every #VALUE_PAIR and its buffer is duplicated.
+ *	If the source list is discarded afterwards, use #fr_pair_list_move
+ *	instead, which relinks and steals the existing pairs.
+ *
  * @param[in] ctx for new #VALUE_PAIR (s) to be allocated in.
  * @param[in] from whence to copy #VALUE_PAIR (s).
  * @return the head of the new #VALUE_PAIR list or NULL on error.
@@ -210,8 +210,8 @@ VALUE_PAIR *fr_pair_cursor_next_by_num(vp_cursor_t *cursor, unsigned int vendor,
 		     i != NULL;
 		     i = i->next) {
 			VERIFY_VP(i);
-			if (i->da->parent->flags.is_root &&
-			    (i->da->attr == attr) && (i->da->vendor == 0) &&
+			if ((i->da->attr == attr) && (i->da->vendor == 0) &&
+			    i->da->parent->flags.is_root &&
 			    (!i->da->flags.has_tag || TAG_EQ(tag, i->tag))) {
 				break;
 			}
@@ -221,8 +221,8 @@ VALUE_PAIR *fr_pair_cursor_next_by_num(vp_cursor_t *cursor, unsigned int vendor,
 		     i != NULL;
 		     i = i->next) {
 			VERIFY_VP(i);
-			if ((i->da->parent->type == FR_TYPE_VENDOR) &&
-			    (i->da->attr == attr) && (i->da->vendor == vendor) &&
+			if ((i->da->attr == attr) && (i->da->vendor == vendor) &&
+			    (i->da->parent->type == FR_TYPE_VENDOR) &&
 			    (!i->da->flags.has_tag || TAG_EQ(tag, i->tag))) {
 				break;
 			}
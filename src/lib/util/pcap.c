@@ -33,6 +33,10 @@
   #include <net/if.h>
 #endif
 
+#ifdef __linux__
+  #include <linux/if_packet.h>
+#endif
+
 #include <freeradius-devel/pcap.h>
 #include <freeradius-devel/net.h>
 #include <freeradius-devel/rad_assert.h>
@@ -266,6 +270,38 @@ int fr_pcap_open(fr_pcap_t *pcap)
 			return -1;
 		}
 
+		/*
+		 *	Join the fanout group.  The kernel hashes each
+		 *	packet's flow to pick a handle in the group, and
+		 *	the hash is symmetric, so both directions of a
+		 *	flow go to the same handle.
+		 */
+		if (pcap->fanout_group) {
+#ifdef PACKET_FANOUT
+			int fanout_type = PACKET_FANOUT_HASH;
+			int fanout;
+
+#  ifdef PACKET_FANOUT_FLAG_DEFRAG
+			fanout_type |= PACKET_FANOUT_FLAG_DEFRAG;	/* So fragments hash with the rest of the packet */
+#  endif
+			fanout = (pcap->fanout_group & 0xffff) | (fanout_type << 16);
+
+			if (setsockopt(pcap_fileno(pcap->handle), SOL_PACKET, PACKET_FANOUT,
+				       &fanout, sizeof(fanout)) < 0) {
+				fr_strerror_printf("Failed joining fanout group %i: %s",
+						   pcap->fanout_group, fr_syserror(errno));
+				pcap_close(pcap->handle);
+				pcap->handle = NULL;
+				return -1;
+			}
+#else
+			fr_strerror_printf("Fanout groups are not supported on this platform");
+			pcap_close(pcap->handle);
+			pcap->handle = NULL;
+			return -1;
+#endif
+		}
+
 		pcap->fd = pcap_get_selectable_fd(pcap->handle);
 		pcap->link_layer = pcap_datalink(pcap->handle);
 #ifndef __linux__
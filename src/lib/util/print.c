@@ -26,6 +26,10 @@ RCSID("$Id$")
 
 #include	<ctype.h>
 
+#ifdef __SSE2__
+#include	<emmintrin.h>
+#endif
+
 /** Checks for utf-8, taken from http://www.w3.org/International/questions/qa-forms-utf-8
  *
  * @param[in] str	input string.
@@ -147,6 +151,7 @@ ssize_t fr_utf8_str(uint8_t const *str, ssize_t inlen)
 	size_t len;
 
 	len = inlen < 0 ? strlen((char const *)str) : (size_t) inlen;
+	if (len == 0) return 0;
 
 	p = str;
 	end = p + len;
@@ -154,6 +159,43 @@ ssize_t fr_utf8_str(uint8_t const *str, ssize_t inlen)
 	do {
 		size_t clen;
 
+#ifdef __SSE2__
+		/*
+		 *	Most strings are printable ASCII, which SSE2
+		 *	can check sixteen bytes at a time.  Bytes with
+		 *	the top bit set are negative, so the signed
+		 *	compare with 0x1f rejects them.
+		 */
+		while ((end - p) >= (ssize_t) sizeof(__m128i)) {
+			__m128i chunk = _mm_loadu_si128((__m128i const *)p);
+			__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8(0x1f)),
+						   _mm_cmplt_epi8(chunk, _mm_set1_epi8(0x7f)));
+
+			if (_mm_movemask_epi8(ok) != 0xffff) break;
+
+			p += sizeof(chunk);
+		}
+#endif
+
+		/*
+		 *	Then eight bytes at a time, which is all we do
+		 *	without SSE2.  A word is all printable if no
+		 *	byte has the top bit set, is less than 0x20, or
+		 *	is 0x7f.
+		 */
+		while ((end - p) >= (ssize_t) sizeof(uint64_t)) {
+			uint64_t word, del;
+
+			memcpy(&word, p, sizeof(word));
+			del = word ^ 0x7f7f7f7f7f7f7f7fULL;
+
+			if (((word | (word - 0x2020202020202020ULL) |
+			      (del - 0x0101010101010101ULL)) & 0x8080808080808080ULL) != 0) break;
+
+			p += sizeof(word);
+		}
+		if (p == end) break;
+
 		clen = fr_utf8_char(p, end - p);
 		if (clen == 0) return end - p;
 		p += clen;
@@ -20,6 +20,10 @@
  * @file rand.c
  * @brief Functions to get randomness
  *
+ * Each thread has its own ISAAC pool, seeded from /dev/urandom the
+ * first time the thread asks for a random number.  So getting random
+ * numbers needs no locks, and threads don't share cache lines.
+ *
  * @copyright 1999-2017  The FreeRADIUS server project
  */
 
@@ -66,6 +70,12 @@ void fr_rand_seed(void const *data, size_t size)
 			fr_rand_pool.randrsl[0] = fd;
 			fr_rand_pool.randrsl[1] = time(NULL);
 			fr_rand_pool.randrsl[2] = errno;
+
+			/*
+			 *	So that threads started in the same
+			 *	second don't get the same numbers.
+			 */
+			fr_rand_pool.randrsl[3] = (uint32_t) (uintptr_t) &fr_rand_pool;
 		}
 
 		fr_randinit(&fr_rand_pool, 1);
@@ -108,3 +118,42 @@ uint32_t fr_rand(void)
 
 	return num;
 }
+
+/** Fill a buffer with random data
+ *
+ * Copies whole runs of pre-generated numbers from the pool, rather
+ * than calling fr_rand() for every four bytes, or every byte.
+ *
+ * @param[out] out	Where to write the random data.
+ * @param[in] len	of the buffer.
+ */
+void fr_rand_bytes(void *out, size_t len)
+{
+	uint8_t	*p = out;
+	size_t	copy;
+
+	/*
+	 *	Ensure that the pool is initialized.
+	 */
+	if (!fr_rand_initialized) {
+		fr_rand_seed(NULL, 0);
+	}
+
+	while (len > 0) {
+		copy = (256 - fr_rand_pool.randcnt) * sizeof(fr_rand_pool.randrsl[0]);
+		if (copy > len) copy = len;
+
+		memcpy(p, &fr_rand_pool.randrsl[fr_rand_pool.randcnt], copy);
+		p += copy;
+		len -= copy;
+
+		/*
+		 *	A partly used number isn't used again.
+		 */
+		fr_rand_pool.randcnt += (copy + sizeof(fr_rand_pool.randrsl[0]) - 1) / sizeof(fr_rand_pool.randrsl[0]);
+		if (fr_rand_pool.randcnt >= 256) {
+			fr_rand_pool.randcnt = 0;
+			fr_isaac(&fr_rand_pool);
+		}
+	}
+}
@@ -29,6 +29,10 @@
 
 #include <fcntl.h>
 
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+#  include <linux/filter.h>
+#endif
+
 /** Resolve a named service to a port
  *
  * @param[in] proto	The protocol. Either IPPROTO_TCP or IPPROTO_UDP.
@@ -905,3 +909,91 @@ int fr_socket_bind(int sockfd, fr_ipaddr_t const *src_ipaddr, uint16_t *src_port
 
 	return 0;
 }
+
+/** Allow multiple sockets to bind to the same address and port
+ *
+ * Must be called before fr_socket_bind().  The kernel then
+ * distributes incoming packets across all of the sockets.
+ *
+ * @param[in] sockfd	the socket which opened by fr_socket_server_*.
+ * @return
+ *	- 0 on success
+ *	- -1 on failure.
+ */
+int fr_socket_reuse_port(int sockfd)
+{
+#ifdef SO_REUSEPORT
+	int on = 1;
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+		fr_strerror_printf("Failed setting SO_REUSEPORT: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+#else
+	fr_strerror_printf("SO_REUSEPORT is not supported on this platform");
+	return -1;
+#endif
+}
+
+/** Steer packets from one source IP address to one socket of a SO_REUSEPORT group
+ *
+ * By default, the kernel picks a socket using a hash of the source
+ * and destination IP addresses and ports.  This function installs a
+ * filter which uses only the source IP address, so that all packets
+ * from a client go to the same socket, even if the client changes
+ * its source port.
+ *
+ * The filter applies to the whole group.  Calling it again replaces
+ * the filter, so it should be called each time the group grows.
+ *
+ * @param[in] sockfd	any bound socket in the group.
+ * @param[in] num	the number of sockets in the group.
+ * @return
+ *	- 0 on success
+ *	- -1 on failure.
+ */
+int fr_socket_reuse_port_steer(int sockfd, uint32_t num)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	struct sock_filter code[] = {
+		/* A = ip->version */
+		{ BPF_LD | BPF_B | BPF_ABS, 0, 0, (uint32_t) SKF_NET_OFF },
+		{ BPF_ALU | BPF_RSH | BPF_K, 0, 0, 4 },
+		{ BPF_JMP | BPF_JEQ | BPF_K, 0, 2, 4 },
+
+		/* A = ip->saddr */
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t) SKF_NET_OFF + 12 },
+		{ BPF_JMP | BPF_JA, 0, 0, 1 },
+
+		/* A = last 32 bits of ip6->saddr */
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t) SKF_NET_OFF + 20 },
+
+		/* return A % num */
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, 0 },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+
+	if (!num) {
+		fr_strerror_printf("Invalid number of sockets");
+		return -1;
+	}
+
+	code[6].k = num;
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+		fr_strerror_printf("Failed setting SO_ATTACH_REUSEPORT_CBPF: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+#else
+	fr_strerror_printf("Steering packets in a SO_REUSEPORT group is not supported on this platform");
+	return -1;
+#endif
+}
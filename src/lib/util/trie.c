@@ -0,0 +1,446 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * @file lib/util/trie.c
+ * @brief Longest prefix match of IP addresses.
+ *
+ * Prefixes are inserted into a binary trie, which is then compiled into
+ * a multibit trie that can't be changed.  Each node of the compiled trie
+ * looks at 6 bits of the address, so a lookup visits at most 6 nodes for
+ * IPv4, and 22 for IPv6.
+ *
+ * The 64 slots of a node are compressed with two bitmaps, as in poptrie.
+ * "vector" marks the slots which have a child node, and "leafvec" marks
+ * the slots where a run of slots with the same longest match starts.
+ * The child or leaf for a slot is found by counting the bits set below
+ * it.  Shorter prefixes are pushed down into the leaves when the trie
+ * is compiled, so a lookup never backtracks.
+ *
+ * Lookups don't change the trie, so any number of threads can use it
+ * without locks.  To change the prefixes, compile a new trie, and swap
+ * it in.
+ *
+ * @copyright 2026  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/trie.h>
+#include <freeradius-devel/rad_assert.h>
+
+#define TRIE_STRIDE	6
+
+/** A prefix, and the next shorter prefix which contains it
+ *
+ */
+struct fr_trie_leaf_t {
+	void			*data;
+	fr_trie_leaf_t		*parent;
+};
+
+/** A node of the binary trie, used while inserting prefixes
+ *
+ */
+typedef struct trie_bnode_t trie_bnode_t;
+struct trie_bnode_t {
+	trie_bnode_t		*child[2];
+	fr_trie_leaf_t		*leaf;		//!< If a prefix ends here.
+};
+
+/** A node of the compiled trie
+ *
+ */
+typedef struct trie_node_t trie_node_t;
+struct trie_node_t {
+	uint64_t		vector;		//!< Slots which have a child node.
+	uint64_t		leafvec;	//!< Slots which start a run of leaves.
+	trie_node_t		*children;	//!< One per bit set in "vector".
+	fr_trie_leaf_t		**leaves;	//!< One per bit set in "leafvec".  NULL if nothing matches.
+};
+
+struct fr_trie_t {
+	TALLOC_CTX		*build;		//!< Holds the binary trie, until we compile.
+	trie_bnode_t		*broot[2];	//!< Binary tries for IPv4 and IPv6.
+
+	trie_node_t		root[2];	//!< Compiled tries for IPv4 and IPv6.
+	bool			compiled;
+};
+
+static inline unsigned int trie_popcount(uint64_t x)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll(x);
+#else
+	unsigned int count;
+
+	for (count = 0; x; count++) x &= x - 1;
+
+	return count;
+#endif
+}
+
+/** Return the address bits, and the index of the trie for the family
+ *
+ */
+static int trie_addr(fr_ipaddr_t const *ipaddr, uint8_t const **addr, unsigned int *max_bits)
+{
+	switch (ipaddr->af) {
+	case AF_INET:
+		*addr = (uint8_t const *) &ipaddr->addr.v4.s_addr;
+		*max_bits = 32;
+		return 0;
+
+#ifdef HAVE_STRUCT_SOCKADDR_IN6
+	case AF_INET6:
+		*addr = ipaddr->addr.v6.s6_addr;
+		*max_bits = 128;
+		return 1;
+#endif
+
+	default:
+		return -1;
+	}
+}
+
+/** Return TRIE_STRIDE bits of the address, starting at "depth"
+ *
+ * Bits past the end of the address are zero.
+ */
+static inline unsigned int trie_chunk(uint8_t const *addr, unsigned int max_bits, unsigned int depth)
+{
+	unsigned int	byte = depth >> 3;
+	uint16_t	window;
+
+	window = addr[byte] << 8;
+	if (((byte + 1) << 3) < max_bits) window |= addr[byte + 1];
+
+	return (window >> (16 - TRIE_STRIDE - (depth & 7))) & ((1 << TRIE_STRIDE) - 1);
+}
+
+/** Allocate an empty trie
+ *
+ * @param[in] ctx	to allocate the trie in.
+ * @return
+ *	- The new trie.
+ *	- NULL on error.
+ */
+fr_trie_t *fr_trie_alloc(TALLOC_CTX *ctx)
+{
+	fr_trie_t *trie;
+
+	trie = talloc_zero(ctx, fr_trie_t);
+	if (!trie) return NULL;
+
+	trie->build = talloc_pool(trie, 4096);
+	if (!trie->build) {
+	error:
+		talloc_free(trie);
+		return NULL;
+	}
+
+	trie->broot[0] = talloc_zero(trie->build, trie_bnode_t);
+	if (!trie->broot[0]) goto error;
+
+	trie->broot[1] = talloc_zero(trie->build, trie_bnode_t);
+	if (!trie->broot[1]) goto error;
+
+	return trie;
+}
+
+/** Find the binary trie node for a prefix
+ *
+ */
+static trie_bnode_t *trie_bnode_find(fr_trie_t const *trie, fr_ipaddr_t const *prefix, bool create)
+{
+	uint8_t const	*addr;
+	unsigned int	max_bits, i;
+	int		family;
+	trie_bnode_t	*b;
+
+	family = trie_addr(prefix, &addr, &max_bits);
+	if (family < 0) {
+		fr_strerror_printf("Unsupported address family %i", prefix->af);
+		return NULL;
+	}
+
+	if (prefix->prefix > max_bits) {
+		fr_strerror_printf("Invalid prefix length %u", prefix->prefix);
+		return NULL;
+	}
+
+	b = trie->broot[family];
+	for (i = 0; i < prefix->prefix; i++) {
+		int bit = (addr[i >> 3] >> (7 - (i & 7))) & 0x01;
+
+		if (!b->child[bit]) {
+			if (!create) return NULL;
+
+			b->child[bit] = talloc_zero(trie->build, trie_bnode_t);
+			if (!b->child[bit]) {
+				fr_strerror_printf("Out of memory");
+				return NULL;
+			}
+		}
+		b = b->child[bit];
+	}
+
+	return b;
+}
+
+/** Add a prefix to a trie
+ *
+ * May only be called before fr_trie_compile().
+ *
+ * @param[in] trie	to add the prefix to.
+ * @param[in] prefix	to add.  Only the first "prefix" bits of the address are used.
+ * @param[in] data	to return when the prefix is the longest match.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error, or if the prefix is already in the trie.
+ */
+int fr_trie_insert(fr_trie_t *trie, fr_ipaddr_t const *prefix, void *data)
+{
+	trie_bnode_t *b;
+
+	rad_assert(!trie->compiled);
+
+	b = trie_bnode_find(trie, prefix, true);
+	if (!b) return -1;
+
+	if (b->leaf) {
+		fr_strerror_printf("Prefix is already in the trie");
+		return -1;
+	}
+
+	b->leaf = talloc_zero(trie, fr_trie_leaf_t);
+	if (!b->leaf) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+	b->leaf->data = data;
+
+	return 0;
+}
+
+/** Return the data for a prefix which has been inserted
+ *
+ * May only be called before fr_trie_compile().
+ *
+ * @param[in] trie	to look in.
+ * @param[in] prefix	to look for.
+ * @return
+ *	- The data for the prefix.
+ *	- NULL if the prefix isn't in the trie.
+ */
+void *fr_trie_exact(fr_trie_t const *trie, fr_ipaddr_t const *prefix)
+{
+	trie_bnode_t *b;
+
+	rad_assert(!trie->compiled);
+
+	b = trie_bnode_find(trie, prefix, false);
+	if (!b || !b->leaf) return NULL;
+
+	return b->leaf->data;
+}
+
+/** Point each prefix at the next shorter prefix which contains it
+ *
+ */
+static void trie_parents(trie_bnode_t *b, fr_trie_leaf_t *parent)
+{
+	if (!b) return;
+
+	if (b->leaf) {
+		b->leaf->parent = parent;
+		parent = b->leaf;
+	}
+
+	trie_parents(b->child[0], parent);
+	trie_parents(b->child[1], parent);
+}
+
+/** Compile the part of the binary trie below "b" into "node"
+ *
+ * @param[in] ctx	to allocate the node's arrays in.
+ * @param[out] node	to fill in.
+ * @param[in] b		binary trie node at "depth".
+ * @param[in] depth	of "b", in bits.
+ * @param[in] best	longest prefix which matches at "b".
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+static int trie_compile_node(TALLOC_CTX *ctx, trie_node_t *node, trie_bnode_t *b,
+			     unsigned int depth, fr_trie_leaf_t *best)
+{
+	trie_bnode_t	*below[1 << TRIE_STRIDE];
+	fr_trie_leaf_t	*match[1 << TRIE_STRIDE];
+	fr_trie_leaf_t	*last = NULL;
+	unsigned int	v, k, num_children = 0, num_leaves = 0;
+	bool		in_run = false;
+
+	for (v = 0; v < (1 << TRIE_STRIDE); v++) {
+		trie_bnode_t	*n = b;
+		fr_trie_leaf_t	*m = best;
+
+		for (k = 0; n && (k < TRIE_STRIDE); k++) {
+			n = n->child[(v >> (TRIE_STRIDE - 1 - k)) & 0x01];
+			if (n && n->leaf) m = n->leaf;
+		}
+
+		match[v] = m;
+		below[v] = (n && (n->child[0] || n->child[1])) ? n : NULL;
+
+		if (below[v]) {
+			node->vector |= ((uint64_t) 1) << v;
+			num_children++;
+			in_run = false;
+			continue;
+		}
+
+		if (in_run && (m == last)) continue;
+
+		node->leafvec |= ((uint64_t) 1) << v;
+		num_leaves++;
+		last = m;
+		in_run = true;
+	}
+
+	if (num_children) {
+		node->children = talloc_zero_array(ctx, trie_node_t, num_children);
+		if (!node->children) return -1;
+	}
+
+	if (num_leaves) {
+		node->leaves = talloc_array(ctx, fr_trie_leaf_t *, num_leaves);
+		if (!node->leaves) return -1;
+	}
+
+	num_children = num_leaves = 0;
+	for (v = 0; v < (1 << TRIE_STRIDE); v++) {
+		uint64_t bit = ((uint64_t) 1) << v;
+
+		if (node->vector & bit) {
+			if (trie_compile_node(ctx, &node->children[num_children++], below[v],
+					      depth + TRIE_STRIDE, match[v]) < 0) return -1;
+			continue;
+		}
+
+		if (node->leafvec & bit) node->leaves[num_leaves++] = match[v];
+	}
+
+	return 0;
+}
+
+/** Compile the prefixes, so that the trie can be used for lookups
+ *
+ * No more prefixes can be added afterwards.
+ *
+ * @param[in] trie	to compile.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_trie_compile(fr_trie_t *trie)
+{
+	int i;
+
+	rad_assert(!trie->compiled);
+
+	for (i = 0; i < 2; i++) {
+		trie_parents(trie->broot[i], NULL);
+
+		if (trie_compile_node(trie, &trie->root[i], trie->broot[i], 0, trie->broot[i]->leaf) < 0) {
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+	}
+
+	TALLOC_FREE(trie->build);
+	trie->broot[0] = trie->broot[1] = NULL;
+	trie->compiled = true;
+
+	return 0;
+}
+
+/** Find the longest prefix which contains an address
+ *
+ * @param[in] trie	to look in.  Must have been compiled.
+ * @param[out] cursor	for fr_trie_next().  May be NULL.
+ * @param[in] ipaddr	to look for.
+ * @return
+ *	- The data for the longest prefix.
+ *	- NULL if no prefix contains the address.
+ */
+void *fr_trie_find(fr_trie_t const *trie, fr_trie_cursor_t *cursor, fr_ipaddr_t const *ipaddr)
+{
+	trie_node_t const	*node;
+	fr_trie_leaf_t const	*leaf;
+	uint8_t const		*addr;
+	unsigned int		max_bits, depth = 0;
+	int			family;
+
+	rad_assert(trie->compiled);
+
+	if (cursor) *cursor = NULL;
+
+	family = trie_addr(ipaddr, &addr, &max_bits);
+	if (family < 0) return NULL;
+
+	node = &trie->root[family];
+	for (;;) {
+		uint64_t	bit = ((uint64_t) 1) << trie_chunk(addr, max_bits, depth);
+		uint64_t	below = (bit << 1) - 1;		/* Wraps to all ones for the last slot */
+		unsigned int	idx;
+
+		if (node->vector & bit) {
+			node = &node->children[trie_popcount(node->vector & below) - 1];
+			depth += TRIE_STRIDE;
+			continue;
+		}
+
+		idx = trie_popcount(node->leafvec & below);
+		if (!idx) return NULL;
+
+		leaf = node->leaves[idx - 1];
+		break;
+	}
+
+	if (!leaf) return NULL;
+
+	if (cursor) *cursor = leaf;
+
+	return leaf->data;
+}
+
+/** Return the next shorter prefix which contains the address
+ *
+ * @param[in,out] cursor	from fr_trie_find().
+ * @return
+ *	- The data for the prefix.
+ *	- NULL if there are no more prefixes.
+ */
+void *fr_trie_next(fr_trie_cursor_t *cursor)
+{
+	if (!*cursor) return NULL;
+
+	*cursor = (*cursor)->parent;
+	if (!*cursor) return NULL;
+
+	return (*cursor)->data;
+}
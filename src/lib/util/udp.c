@@ -38,6 +38,14 @@ RCSID("$Id$")
 
 #define FR_DEBUG_STRERROR_PRINTF if (fr_debug_lvl) fr_strerror_printf
 
+/*
+ *	recvmmsg() and sendmmsg() are Linux specific.  Elsewhere
+ *	we fall back to one datagram per system call.
+ */
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#  define UDP_MMSG
+#endif
+
 /** Send a packet via a UDP socket.
  *
  * @param[in] sockfd we're reading from.
@@ -237,3 +245,223 @@ ssize_t udp_recv(int sockfd, void *data, size_t data_len, int flags,
 
 	return received;
 }
+
+/** Read multiple datagrams from a socket
+ *
+ * This function never blocks.  Where recvmmsg() is available, all
+ * of the datagrams are read with one system call.  Otherwise, only
+ * one datagram is read.
+ *
+ * @param[in] sockfd	the socket to read from.
+ * @param[in,out] dg	array of datagrams.  "data" and "data_len" must
+ *			be set to the buffer for each datagram.
+ * @param[in] num	number of entries in the array.
+ * @return
+ *	- <0 on error.
+ *	- 0 if there is no data to read.
+ *	- >0 the number of datagrams which were read.
+ */
+int udp_recv_batch(int sockfd, udp_datagram_t *dg, int num)
+{
+#ifdef UDP_MMSG
+	int			i, received;
+	struct timeval		now = { 0, 0 };
+	struct sockaddr_storage	local;
+	socklen_t		sizeof_local = sizeof(local);
+	struct mmsghdr		msg[UDP_BATCH_MAX];
+	struct iovec		iov[UDP_BATCH_MAX];
+	struct sockaddr_storage	src[UDP_BATCH_MAX];
+#ifdef WITH_UDPFROMTO
+	uint8_t			cbuf[UDP_BATCH_MAX][UDPFROMTO_CMSG_SPACE];
+#endif
+
+	if (num > UDP_BATCH_MAX) num = UDP_BATCH_MAX;
+
+	/*
+	 *	The destination port isn't in the control data, so
+	 *	get the local address once for the whole batch.
+	 */
+	if (getsockname(sockfd, (struct sockaddr *) &local, &sizeof_local) < 0) {
+		fr_strerror_printf("Failed getting socket name: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	memset(msg, 0, sizeof(msg[0]) * num);
+	for (i = 0; i < num; i++) {
+		iov[i].iov_base = dg[i].data;
+		iov[i].iov_len = dg[i].data_len;
+
+		msg[i].msg_hdr.msg_name = &src[i];
+		msg[i].msg_hdr.msg_namelen = sizeof(src[i]);
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+#ifdef WITH_UDPFROMTO
+		msg[i].msg_hdr.msg_control = cbuf[i];
+		msg[i].msg_hdr.msg_controllen = sizeof(cbuf[i]);
+#endif
+	}
+
+	received = recvmmsg(sockfd, msg, num, MSG_DONTWAIT, NULL);
+	if (received < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+		fr_strerror_printf("udp_recv_batch failed: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < received; i++) {
+		struct sockaddr_storage	dst = local;
+		socklen_t		sizeof_dst = sizeof_local;
+
+		dg[i].data_len = msg[i].msg_len;
+		dg[i].if_index = 0;
+		dg[i].when.tv_sec = 0;
+		dg[i].when.tv_usec = 0;
+
+		/*
+		 *	Convert AF.  If unknown, ignore the packet.
+		 */
+		if (fr_ipaddr_from_sockaddr(&src[i], msg[i].msg_hdr.msg_namelen,
+					    &dg[i].src_ipaddr, &dg[i].src_port) < 0) {
+			dg[i].data_len = 0;
+			continue;
+		}
+
+#ifdef WITH_UDPFROMTO
+		recvfromto_cmsg(&msg[i].msg_hdr, (struct sockaddr *) &dst, &sizeof_dst,
+				&dg[i].if_index, &dg[i].when);
+#endif
+		fr_ipaddr_from_sockaddr(&dst, sizeof_dst, &dg[i].dst_ipaddr, &dg[i].dst_port);
+
+		/*
+		 *	One timestamp for all of the packets which
+		 *	don't have their own.
+		 */
+		if (!dg[i].when.tv_sec) {
+			if (!now.tv_sec) gettimeofday(&now, NULL);
+			dg[i].when = now;
+		}
+	}
+
+	return received;
+#else
+	ssize_t received;
+
+	if (num <= 0) return 0;
+
+	received = udp_recv(sockfd, dg[0].data, dg[0].data_len, 0,
+			    &dg[0].src_ipaddr, &dg[0].src_port,
+			    &dg[0].dst_ipaddr, &dg[0].dst_port,
+			    &dg[0].if_index, &dg[0].when);
+	if (received < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+		return -1;
+	}
+
+	dg[0].data_len = received;
+	return 1;
+#endif
+}
+
+/** Write multiple datagrams to a socket
+ *
+ * Where sendmmsg() is available, all of the datagrams are written
+ * with as few system calls as possible.  Otherwise, they are
+ * written one at a time.
+ *
+ * Datagrams which can't be sent are dropped, just as they would
+ * be if the network had dropped them.
+ *
+ * @param[in] sockfd	the socket to write to.
+ * @param[in] dg	array of datagrams.  The "src_ipaddr" may be
+ *			AF_UNSPEC, in which case the OS chooses the
+ *			source address.
+ * @param[in] num	number of entries in the array.
+ * @return
+ *	- the number of datagrams which were sent.
+ */
+int udp_send_batch(int sockfd, udp_datagram_t *dg, int num)
+{
+	int			i, sent = 0;
+#ifdef UDP_MMSG
+	int			j, done;
+	struct mmsghdr		msg[UDP_BATCH_MAX];
+	struct iovec		iov[UDP_BATCH_MAX];
+	struct sockaddr_storage	dst[UDP_BATCH_MAX];
+#ifdef WITH_UDPFROMTO
+	uint8_t			cbuf[UDP_BATCH_MAX][UDPFROMTO_CMSG_SPACE];
+#endif
+
+	while (num > 0) {
+		int todo = (num > UDP_BATCH_MAX) ? UDP_BATCH_MAX : num;
+
+		memset(msg, 0, sizeof(msg[0]) * todo);
+		for (i = 0, j = 0; i < todo; i++) {
+			socklen_t sizeof_dst;
+
+			if (fr_ipaddr_to_sockaddr(&dg[i].dst_ipaddr, dg[i].dst_port, &dst[j], &sizeof_dst) < 0) continue;
+
+			iov[j].iov_base = dg[i].data;
+			iov[j].iov_len = dg[i].data_len;
+
+			msg[j].msg_hdr.msg_name = &dst[j];
+			msg[j].msg_hdr.msg_namelen = sizeof_dst;
+			msg[j].msg_hdr.msg_iov = &iov[j];
+			msg[j].msg_hdr.msg_iovlen = 1;
+
+#ifdef WITH_UDPFROMTO
+			/*
+			 *	Same rules as udp_send()
+			 */
+			if ((dg[i].src_ipaddr.af != AF_UNSPEC) && (dg[i].dst_ipaddr.af != AF_UNSPEC) &&
+			    !fr_ipaddr_is_inaddr_any(&dg[i].src_ipaddr)) {
+				struct sockaddr_storage	src;
+				socklen_t		sizeof_src;
+
+				fr_ipaddr_to_sockaddr(&dg[i].src_ipaddr, dg[i].src_port, &src, &sizeof_src);
+				sendfromto_cmsg(&msg[j].msg_hdr, cbuf[j], sizeof(cbuf[j]),
+						(struct sockaddr *) &src, dg[i].if_index);
+			}
+#endif
+			j++;
+		}
+
+		done = 0;
+		while (done < j) {
+			int rcode;
+
+			rcode = sendmmsg(sockfd, msg + done, j - done, 0);
+			if (rcode < 0) {
+				if (errno == EINTR) continue;
+
+				/*
+				 *	No buffer space: drop the rest.
+				 */
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS)) break;
+
+				/*
+				 *	The first packet failed, skip it.
+				 */
+				fr_strerror_printf("udp_send_batch failed: %s", fr_syserror(errno));
+				done++;
+				continue;
+			}
+
+			done += rcode;
+			sent += rcode;
+		}
+
+		dg += todo;
+		num -= todo;
+	}
+#else
+	for (i = 0; i < num; i++) {
+		if (udp_send(sockfd, dg[i].data, dg[i].data_len, 0,
+			     &dg[i].src_ipaddr, dg[i].src_port, dg[i].if_index,
+			     &dg[i].dst_ipaddr, dg[i].dst_port) < 0) continue;
+		sent++;
+	}
+#endif
+
+	return sent;
+}
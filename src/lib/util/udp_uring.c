@@ -0,0 +1,811 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file util/udp_uring.c
+ * @brief Send and receive batches of UDP datagrams via io_uring.
+ *
+ * Datagrams are received with one multishot recvmsg, into a ring of
+ * buffers which is provided to the kernel once, when the ring is
+ * created.  Replies are queued as sendmsg requests, and submitted
+ * with one system call per batch.
+ *
+ * The caller polls the ring descriptor, not the socket.  The ring
+ * descriptor is readable whenever there are completions to reap.
+ *
+ * @copyright 2017  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/udp_uring.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+
+/*
+ *	Multishot receive needs the headers from a 6.0 or later
+ *	kernel.  Provided buffer rings are older, and are an enum,
+ *	so there's nothing else to check for.
+ */
+#  if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#    define UDP_URING
+#  endif
+#endif
+
+#ifdef UDP_URING
+/*
+ *	The buffer group ID used for the receive buffers.
+ */
+#define UDP_URING_BGID		(0)
+
+/*
+ *	user_data for completions which aren't replies.
+ */
+#define UDP_URING_RECV		(0)
+#define UDP_URING_WAKE		(UINT64_MAX)
+
+/*
+ *	Room for the largest source address we'll receive.
+ */
+#define UDP_URING_NAME_SPACE	(sizeof(struct sockaddr_storage))
+
+#ifdef WITH_UDPFROMTO
+#  define UDP_URING_CMSG_SPACE	UDPFROMTO_CMSG_SPACE
+#else
+#  define UDP_URING_CMSG_SPACE	(0)
+#endif
+
+/** One reply which has been queued, but not yet completed
+ *
+ */
+typedef struct {
+	struct msghdr		msg;				//!< Passed to the kernel by reference.
+	struct iovec		iov;
+	struct sockaddr_storage	dst;
+#ifdef WITH_UDPFROMTO
+	uint8_t			cbuf[UDPFROMTO_CMSG_SPACE];	//!< Source address and interface.
+#endif
+	uint8_t			*data;				//!< A copy of the reply.
+} udp_uring_tx_t;
+
+/** A receive completion which was reaped while looking for send completions
+ *
+ */
+typedef struct {
+	int32_t			res;
+	uint32_t		flags;
+} udp_uring_cqe_t;
+
+struct udp_uring_t {
+	int			sockfd;			//!< The UDP socket.
+	int			fd;			//!< The ring.
+
+	void			*sq_ptr;		//!< Mapped submission ring.
+	size_t			sq_size;
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		sq_mask;
+	unsigned		sq_entries;
+	unsigned		*sq_array;
+	unsigned		sq_queued;		//!< Entries we haven't yet submitted.
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_size;
+
+	void			*cq_ptr;		//!< Mapped completion ring.  May be the
+							///< same mapping as the submission ring.
+	size_t			cq_size;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	struct io_uring_buf_ring *br;			//!< Provided buffer ring.
+	size_t			br_size;
+	unsigned		br_entries;
+	uint16_t		br_tail;
+	uint8_t			*buffers;		//!< br_entries * buf_size bytes of packet data.
+	size_t			buf_size;
+	uint16_t		*recycle;		//!< Buffers returned by the last udp_uring_recv().
+	int			num_recycle;
+
+	udp_uring_cqe_t		*rq;			//!< Receive completions which we reaped early.
+	int			rq_head;
+	int			rq_num;
+	bool			armed;			//!< Whether the multishot receive is active.
+
+	struct msghdr		rx_msg;			//!< Sizes of the name and control areas.
+	struct sockaddr_storage	local;			//!< Default destination address.
+	socklen_t		local_len;
+
+	udp_uring_tx_t		*tx;			//!< Reply slots.
+	int			*tx_free;		//!< Stack of free reply slots.
+	int			num_free;
+	size_t			tx_size;		//!< Largest reply we can send.
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static unsigned roundup_pow2(unsigned num)
+{
+	unsigned n = 1;
+
+	while (n < num) n <<= 1;
+
+	return n;
+}
+
+static int _udp_uring_free(udp_uring_t *ur)
+{
+	/*
+	 *	Closing the ring cancels the multishot receive, and
+	 *	any replies which are still in flight.
+	 */
+	if (ur->fd >= 0) close(ur->fd);
+
+	if (ur->br) munmap(ur->br, ur->br_size);
+	if (ur->sqes) munmap(ur->sqes, ur->sqes_size);
+	if (ur->cq_ptr && (ur->cq_ptr != ur->sq_ptr)) munmap(ur->cq_ptr, ur->cq_size);
+	if (ur->sq_ptr) munmap(ur->sq_ptr, ur->sq_size);
+
+	return 0;
+}
+
+/** Get a submission queue entry
+ *
+ * @return
+ *	- NULL if the submission queue is full.
+ *	- the entry, zeroed.
+ */
+static struct io_uring_sqe *udp_uring_sqe(udp_uring_t *ur)
+{
+	unsigned		head, tail;
+	struct io_uring_sqe	*sqe;
+
+	head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+	tail = *ur->sq_tail + ur->sq_queued;
+	if ((tail - head) >= ur->sq_entries) return NULL;
+
+	sqe = &ur->sqes[tail & ur->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ur->sq_array[tail & ur->sq_mask] = tail & ur->sq_mask;
+	ur->sq_queued++;
+
+	return sqe;
+}
+
+/** Submit all of the queued entries
+ *
+ */
+static int udp_uring_submit(udp_uring_t *ur, unsigned min_complete)
+{
+	int		rcode;
+	unsigned	todo = ur->sq_queued;
+
+	if (!todo && !min_complete) return 0;
+
+	__atomic_store_n(ur->sq_tail, *ur->sq_tail + todo, __ATOMIC_RELEASE);
+	ur->sq_queued = 0;
+
+	do {
+		rcode = io_uring_enter(ur->fd, todo, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0);
+	} while ((rcode < 0) && (errno == EINTR));
+
+	if (rcode < 0) {
+		fr_strerror_printf("Failed submitting to io_uring: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Give buffers back to the kernel
+ *
+ */
+static void udp_uring_buffers_add(udp_uring_t *ur, uint16_t const *bid, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		struct io_uring_buf *buf = &ur->br->bufs[(ur->br_tail + i) & (ur->br_entries - 1)];
+
+		buf->addr = (uint64_t) (uintptr_t) (ur->buffers + (bid[i] * ur->buf_size));
+		buf->len = ur->buf_size;
+		buf->bid = bid[i];
+	}
+
+	ur->br_tail += num;
+	__atomic_store_n(&ur->br->tail, ur->br_tail, __ATOMIC_RELEASE);
+}
+
+/** (Re-)start the multishot receive
+ *
+ */
+static int udp_uring_arm(udp_uring_t *ur)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = udp_uring_sqe(ur);
+	if (!sqe) return 0;	/* try again on the next call */
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = ur->sockfd;
+	sqe->addr = (uint64_t) (uintptr_t) &ur->rx_msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = UDP_URING_BGID;
+	sqe->user_data = UDP_URING_RECV;
+
+	ur->armed = true;
+
+	return udp_uring_submit(ur, 0);
+}
+
+/** Make the ring readable
+ *
+ * The ring is only readable when there are completions to reap.
+ * Queue a no-op so that the caller is woken up to read the packets
+ * we parked.  It's submitted with the next batch of entries.
+ */
+static void udp_uring_wake(udp_uring_t *ur)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = udp_uring_sqe(ur);
+	if (!sqe) return;
+
+	sqe->opcode = IORING_OP_NOP;
+	sqe->user_data = UDP_URING_WAKE;
+}
+
+/** Reap one completion which isn't a receive
+ *
+ * @return
+ *	- true if the completion was handled.
+ *	- false if it's a receive completion.
+ */
+static bool udp_uring_reap_other(udp_uring_t *ur, struct io_uring_cqe const *cqe)
+{
+	if (cqe->user_data == UDP_URING_RECV) return false;
+
+	if (cqe->user_data != UDP_URING_WAKE) {
+		/*
+		 *	Errors from sendmsg() are treated the same
+		 *	way as packets dropped by the network.
+		 */
+		ur->tx_free[ur->num_free++] = cqe->user_data - 1;
+	}
+
+	return true;
+}
+
+/** Reap the send completions, and park any receive completions
+ *
+ */
+static void udp_uring_reap_tx(udp_uring_t *ur)
+{
+	unsigned head, tail;
+	bool parked = false;
+
+	head = *ur->cq_head;
+	tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &ur->cqes[head & ur->cq_mask];
+
+		head++;
+		if (udp_uring_reap_other(ur, cqe)) continue;
+
+		/*
+		 *	The queue can hold one completion for every
+		 *	buffer, which is as many as the kernel can
+		 *	give us.  Except for errors, which we can
+		 *	drop, as the receive is then disarmed.
+		 */
+		if (ur->rq_num == (int) ur->br_entries) {
+			if (!(cqe->flags & IORING_CQE_F_MORE)) ur->armed = false;
+			if (cqe->flags & IORING_CQE_F_BUFFER) {
+				uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+				udp_uring_buffers_add(ur, &bid, 1);
+			}
+			continue;
+		}
+
+		ur->rq[(ur->rq_head + ur->rq_num) % ur->br_entries] = (udp_uring_cqe_t) {
+			.res = cqe->res,
+			.flags = cqe->flags
+		};
+		ur->rq_num++;
+		parked = true;
+	}
+
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+	if (parked) udp_uring_wake(ur);
+}
+
+/** Convert one receive completion to a datagram
+ *
+ * @return
+ *	- <0 on error.
+ *	- 0 if the completion didn't contain a packet.
+ *	- 1 if the datagram was filled in.
+ */
+static int udp_uring_datagram(udp_uring_t *ur, udp_datagram_t *dg, int32_t res, uint32_t flags)
+{
+	uint16_t			bid;
+	uint8_t				*buffer;
+	struct io_uring_recvmsg_out	*out;
+	struct sockaddr_storage		dst;
+	socklen_t			sizeof_dst;
+
+	if (!(flags & IORING_CQE_F_MORE)) ur->armed = false;
+
+	if (res < 0) {
+		if ((res == -ENOBUFS) || (res == -EAGAIN) || (res == -EINTR)) return 0;
+
+		fr_strerror_printf("udp_uring_recv failed: %s", fr_syserror(-res));
+		return -1;
+	}
+
+	if (!(flags & IORING_CQE_F_BUFFER)) return 0;
+
+	bid = flags >> IORING_CQE_BUFFER_SHIFT;
+	ur->recycle[ur->num_recycle++] = bid;
+
+	buffer = ur->buffers + (bid * ur->buf_size);
+	out = (struct io_uring_recvmsg_out *) buffer;
+
+	/*
+	 *	Truncated packets are useless, so we don't return them.
+	 */
+	if ((out->flags & MSG_TRUNC) || (out->namelen > ur->rx_msg.msg_namelen)) return 0;
+
+	memset(dg, 0, sizeof(*dg));
+	dg->data = buffer + sizeof(*out) + ur->rx_msg.msg_namelen + ur->rx_msg.msg_controllen;
+	dg->data_len = out->payloadlen;
+
+	/*
+	 *	Convert AF.  If unknown, ignore the packet.
+	 */
+	if (fr_ipaddr_from_sockaddr((struct sockaddr_storage *) (buffer + sizeof(*out)), out->namelen,
+				    &dg->src_ipaddr, &dg->src_port) < 0) {
+		dg->data_len = 0;
+		return 1;
+	}
+
+	dst = ur->local;
+	sizeof_dst = ur->local_len;
+
+#ifdef WITH_UDPFROMTO
+	{
+		struct msghdr	msgh;
+
+		/*
+		 *	recvfromto_cmsg() only needs the control data.
+		 */
+		memset(&msgh, 0, sizeof(msgh));
+		msgh.msg_control = buffer + sizeof(*out) + ur->rx_msg.msg_namelen;
+		msgh.msg_controllen = out->controllen;
+
+		recvfromto_cmsg(&msgh, (struct sockaddr *) &dst, &sizeof_dst, &dg->if_index, &dg->when);
+	}
+#endif
+	fr_ipaddr_from_sockaddr(&dst, sizeof_dst, &dg->dst_ipaddr, &dg->dst_port);
+
+	return 1;
+}
+
+/** Allocate an io_uring for a UDP socket
+ *
+ * The socket should already be bound.
+ *
+ * @param[in] ctx	to allocate the ring in.
+ * @param[in] sockfd	the socket to read from, and write to.
+ * @param[in] num	the maximum number of datagrams for one call to
+ *			udp_uring_recv() or udp_uring_send().
+ * @param[in] size	the largest datagram we can receive or send.
+ * @return
+ *	- NULL on error.
+ *	- the ring.
+ */
+udp_uring_t *udp_uring_alloc(TALLOC_CTX *ctx, int sockfd, int num, size_t size)
+{
+	int			i;
+	udp_uring_t		*ur;
+	struct io_uring_params	p;
+	struct io_uring_buf_reg	reg;
+
+	if ((num <= 0) || (num > UDP_BATCH_MAX)) {
+		fr_strerror_printf("Invalid number of datagrams %d", num);
+		return NULL;
+	}
+
+	ur = talloc_zero(ctx, udp_uring_t);
+	if (!ur) {
+	oom:
+		fr_strerror_printf("Failed allocating memory");
+		return NULL;
+	}
+	ur->sockfd = sockfd;
+	ur->fd = -1;
+	talloc_set_destructor(ur, _udp_uring_free);
+
+	ur->local_len = sizeof(ur->local);
+	if (getsockname(sockfd, (struct sockaddr *) &ur->local, &ur->local_len) < 0) {
+		fr_strerror_printf("Failed getting socket name: %s", fr_syserror(errno));
+	error:
+		talloc_free(ur);
+		return NULL;
+	}
+
+	/*
+	 *	Leave room for packets which arrive while the caller
+	 *	is still processing the previous batch.
+	 */
+	ur->br_entries = roundup_pow2(num * 4);
+	ur->rx_msg.msg_namelen = UDP_URING_NAME_SPACE;
+	ur->rx_msg.msg_controllen = UDP_URING_CMSG_SPACE;
+	ur->buf_size = sizeof(struct io_uring_recvmsg_out) + UDP_URING_NAME_SPACE + UDP_URING_CMSG_SPACE + size;
+	ur->tx_size = size;
+
+	ur->buffers = talloc_array(ur, uint8_t, ur->br_entries * ur->buf_size);
+	ur->recycle = talloc_array(ur, uint16_t, ur->br_entries);
+	ur->rq = talloc_array(ur, udp_uring_cqe_t, ur->br_entries);
+	ur->tx = talloc_zero_array(ur, udp_uring_tx_t, num);
+	ur->tx_free = talloc_array(ur, int, num);
+	if (!ur->buffers || !ur->recycle || !ur->rq || !ur->tx || !ur->tx_free) {
+		talloc_free(ur);
+		goto oom;
+	}
+
+	for (i = 0; i < num; i++) {
+		ur->tx[i].data = talloc_array(ur->tx, uint8_t, size);
+		if (!ur->tx[i].data) {
+			talloc_free(ur);
+			goto oom;
+		}
+		ur->tx_free[ur->num_free++] = num - i - 1;
+	}
+
+	/*
+	 *	Every buffer and every reply can have a completion
+	 *	outstanding at the same time, so the completion queue
+	 *	has to be big enough for all of them.
+	 */
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = roundup_pow2(ur->br_entries + num + 2);
+
+	ur->fd = io_uring_setup(roundup_pow2(num + 2), &p);
+	if (ur->fd < 0) {
+		fr_strerror_printf("Failed creating io_uring: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	ur->sq_size = p.sq_off.array + (p.sq_entries * sizeof(unsigned));
+	ur->cq_size = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cq_size > ur->sq_size) ur->sq_size = ur->cq_size;
+		ur->cq_size = ur->sq_size;
+	}
+
+	ur->sq_ptr = mmap(NULL, ur->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ur->fd, IORING_OFF_SQ_RING);
+	if (ur->sq_ptr == MAP_FAILED) {
+		ur->sq_ptr = NULL;
+	map_error:
+		fr_strerror_printf("Failed mapping io_uring: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->cq_ptr = ur->sq_ptr;
+	} else {
+		ur->cq_ptr = mmap(NULL, ur->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				  ur->fd, IORING_OFF_CQ_RING);
+		if (ur->cq_ptr == MAP_FAILED) {
+			ur->cq_ptr = NULL;
+			goto map_error;
+		}
+	}
+
+	ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ur->fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED) {
+		ur->sqes = NULL;
+		goto map_error;
+	}
+
+	ur->sq_head = (unsigned *) ((uint8_t *) ur->sq_ptr + p.sq_off.head);
+	ur->sq_tail = (unsigned *) ((uint8_t *) ur->sq_ptr + p.sq_off.tail);
+	ur->sq_mask = *(unsigned *) ((uint8_t *) ur->sq_ptr + p.sq_off.ring_mask);
+	ur->sq_entries = p.sq_entries;
+	ur->sq_array = (unsigned *) ((uint8_t *) ur->sq_ptr + p.sq_off.array);
+
+	ur->cq_head = (unsigned *) ((uint8_t *) ur->cq_ptr + p.cq_off.head);
+	ur->cq_tail = (unsigned *) ((uint8_t *) ur->cq_ptr + p.cq_off.tail);
+	ur->cq_mask = *(unsigned *) ((uint8_t *) ur->cq_ptr + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *) ((uint8_t *) ur->cq_ptr + p.cq_off.cqes);
+
+	/*
+	 *	The buffer ring has to be page aligned, so it can't
+	 *	come from talloc.
+	 */
+	ur->br_size = ur->br_entries * sizeof(struct io_uring_buf);
+	ur->br = mmap(NULL, ur->br_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (ur->br == MAP_FAILED) {
+		ur->br = NULL;
+		goto map_error;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) ur->br;
+	reg.ring_entries = ur->br_entries;
+	reg.bgid = UDP_URING_BGID;
+
+	if (io_uring_register(ur->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		fr_strerror_printf("Failed registering io_uring buffers: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	for (i = 0; i < (int) ur->br_entries; i++) ur->recycle[i] = i;
+	udp_uring_buffers_add(ur, ur->recycle, ur->br_entries);
+
+	if (udp_uring_arm(ur) < 0) goto error;
+
+	return ur;
+}
+
+/** Get the file descriptor to poll for readability
+ *
+ * @param[in] ur	the ring.
+ * @return the ring's file descriptor.
+ */
+int udp_uring_fd(udp_uring_t const *ur)
+{
+	return ur->fd;
+}
+
+/** Read multiple datagrams from the ring
+ *
+ * The datagram data points to buffers owned by the ring.  The data
+ * is valid until the next call to udp_uring_recv(), which gives the
+ * buffers back to the kernel.  Datagrams which should be ignored
+ * have "data_len" set to zero.
+ *
+ * @param[in] ur	the ring.
+ * @param[out] dg	array of datagrams.  "data" and "data_len"
+ *			are filled in.
+ * @param[in] num	number of entries in the array.
+ * @return
+ *	- <0 on error.
+ *	- 0 if there is no data to read.
+ *	- >0 the number of datagrams which were read.
+ */
+int udp_uring_recv(udp_uring_t *ur, udp_datagram_t *dg, int num)
+{
+	int			received = 0, rcode;
+	unsigned		head, tail;
+	struct timeval		now = { 0, 0 };
+
+	if (ur->num_recycle) {
+		udp_uring_buffers_add(ur, ur->recycle, ur->num_recycle);
+		ur->num_recycle = 0;
+	}
+
+	/*
+	 *	The receive stops when the kernel runs out of buffers.
+	 *	We've just given some back, so start it again.
+	 */
+	if (!ur->armed && (udp_uring_arm(ur) < 0)) return -1;
+
+	/*
+	 *	Packets we found when reaping replies go first.
+	 */
+	while (ur->rq_num && (received < num)) {
+		udp_uring_cqe_t *cqe = &ur->rq[ur->rq_head];
+
+		ur->rq_head = (ur->rq_head + 1) % ur->br_entries;
+		ur->rq_num--;
+
+		rcode = udp_uring_datagram(ur, &dg[received], cqe->res, cqe->flags);
+		if (rcode < 0) return received ? received : -1;
+		received += rcode;
+	}
+
+	/*
+	 *	Anything we leave in the completion queue keeps the
+	 *	ring readable, so we'll be called again.
+	 */
+	head = *ur->cq_head;
+	tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+
+	while ((head != tail) && (received < num)) {
+		struct io_uring_cqe *cqe = &ur->cqes[head & ur->cq_mask];
+
+		head++;
+		if (udp_uring_reap_other(ur, cqe)) continue;
+
+		rcode = udp_uring_datagram(ur, &dg[received], cqe->res, cqe->flags);
+		if (rcode < 0) {
+			__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+			return received ? received : -1;
+		}
+		received += rcode;
+	}
+
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+	/*
+	 *	One timestamp for all of the packets which don't
+	 *	have their own.
+	 */
+	for (rcode = 0; rcode < received; rcode++) {
+		if (dg[rcode].when.tv_sec) continue;
+
+		if (!now.tv_sec) gettimeofday(&now, NULL);
+		dg[rcode].when = now;
+	}
+
+	/*
+	 *	The receive was disarmed while we were reading.  We
+	 *	can't give these buffers back yet, but the kernel
+	 *	still has the others, so start it again now.
+	 *	Otherwise nothing would make the ring readable.
+	 */
+	if (!ur->armed && (udp_uring_arm(ur) < 0)) return received ? received : -1;
+
+	if (ur->rq_num) {
+		udp_uring_wake(ur);
+		(void) udp_uring_submit(ur, 0);
+	}
+
+	return received;
+}
+
+/** Write multiple datagrams to the ring
+ *
+ * The data is copied, so the caller can re-use the buffers as soon
+ * as this function returns.  Datagrams which can't be queued are
+ * dropped, just as they would be if the network had dropped them.
+ *
+ * @param[in] ur	the ring.
+ * @param[in] dg	array of datagrams.  The "src_ipaddr" may be
+ *			AF_UNSPEC, in which case the OS chooses the
+ *			source address.
+ * @param[in] num	number of entries in the array.
+ * @return
+ *	- the number of datagrams which were queued.
+ */
+int udp_uring_send(udp_uring_t *ur, udp_datagram_t *dg, int num)
+{
+	int		i, sent = 0;
+
+	for (i = 0; i < num; i++) {
+		int			slot;
+		socklen_t		sizeof_dst;
+		udp_uring_tx_t		*tx;
+		struct io_uring_sqe	*sqe;
+
+		if (dg[i].data_len > ur->tx_size) continue;
+
+		/*
+		 *	Out of slots.  Submit what we have, and wait
+		 *	for one of the earlier replies to complete.
+		 */
+		if (!ur->num_free) {
+			udp_uring_reap_tx(ur);
+			if (!ur->num_free) {
+				if (udp_uring_submit(ur, 1) < 0) break;
+				udp_uring_reap_tx(ur);
+				if (!ur->num_free) break;
+			}
+		}
+
+		slot = ur->tx_free[ur->num_free - 1];
+		tx = &ur->tx[slot];
+
+		if (fr_ipaddr_to_sockaddr(&dg[i].dst_ipaddr, dg[i].dst_port, &tx->dst, &sizeof_dst) < 0) continue;
+
+		sqe = udp_uring_sqe(ur);
+		if (!sqe) {
+			if (udp_uring_submit(ur, 0) < 0) break;
+			sqe = udp_uring_sqe(ur);
+			if (!sqe) break;
+		}
+		ur->num_free--;
+
+		memcpy(tx->data, dg[i].data, dg[i].data_len);
+		tx->iov.iov_base = tx->data;
+		tx->iov.iov_len = dg[i].data_len;
+
+		memset(&tx->msg, 0, sizeof(tx->msg));
+		tx->msg.msg_name = &tx->dst;
+		tx->msg.msg_namelen = sizeof_dst;
+		tx->msg.msg_iov = &tx->iov;
+		tx->msg.msg_iovlen = 1;
+
+#ifdef WITH_UDPFROMTO
+		/*
+		 *	Same rules as udp_send()
+		 */
+		if ((dg[i].src_ipaddr.af != AF_UNSPEC) && (dg[i].dst_ipaddr.af != AF_UNSPEC) &&
+		    !fr_ipaddr_is_inaddr_any(&dg[i].src_ipaddr)) {
+			struct sockaddr_storage	src;
+			socklen_t		sizeof_src;
+
+			fr_ipaddr_to_sockaddr(&dg[i].src_ipaddr, dg[i].src_port, &src, &sizeof_src);
+			sendfromto_cmsg(&tx->msg, tx->cbuf, sizeof(tx->cbuf),
+					(struct sockaddr *) &src, dg[i].if_index);
+		}
+#endif
+
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = ur->sockfd;
+		sqe->addr = (uint64_t) (uintptr_t) &tx->msg;
+		sqe->len = 1;
+		sqe->user_data = slot + 1;
+
+		sent++;
+	}
+
+	if (udp_uring_submit(ur, 0) < 0) return 0;
+
+	return sent;
+}
+#else
+udp_uring_t *udp_uring_alloc(UNUSED TALLOC_CTX *ctx, UNUSED int sockfd, UNUSED int num, UNUSED size_t size)
+{
+	fr_strerror_printf("io_uring is not supported on this system");
+	return NULL;
+}
+
+int udp_uring_fd(UNUSED udp_uring_t const *ur)
+{
+	return -1;
+}
+
+int udp_uring_recv(UNUSED udp_uring_t *ur, UNUSED udp_datagram_t *dg, UNUSED int num)
+{
+	fr_strerror_printf("io_uring is not supported on this system");
+	return -1;
+}
+
+int udp_uring_send(UNUSED udp_uring_t *ur, UNUSED udp_datagram_t *dg, UNUSED int num)
+{
+	return 0;
+}
+#endif
@@ -642,6 +642,24 @@ int fr_value_box_cmp_op(FR_TOKEN op, fr_value_box_t const *a, fr_value_box_t con
 			return -1;
 		}
 
+	/*
+	 *	Equality doesn't need the ordering that
+	 *	fr_value_box_cmp() works out, so if the lengths
+	 *	differ (or both boxes point at the same buffer)
+	 *	we can answer without looking at the contents.
+	 */
+	case FR_TYPE_VARIABLE_SIZE:
+		if ((a->type != b->type) || ((op != T_OP_CMP_EQ) && (op != T_OP_NE))) goto cmp;
+
+		if (a->datum.length != b->datum.length) {
+			compare = 1;
+		} else if (!a->datum.length || (a->vb_octets == b->vb_octets)) {
+			compare = 0;
+		} else {
+			compare = memcmp(a->vb_octets, b->vb_octets, a->datum.length);
+		}
+		break;
+
 	default:
 	cmp:
 		compare = fr_value_box_cmp(a, b);
@@ -1262,6 +1280,7 @@ ssize_t fr_value_box_from_network(TALLOC_CTX *ctx,
 	case FR_TYPE_DATE_MICROSECONDS:
 	case FR_TYPE_DATE_NANOSECONDS:
 		memcpy(((uint8_t *)&dst->datum) + fr_value_box_offsets[type], src, len);
+		dst->type = type;		/* fr_value_box_hton switches on it */
 		fr_value_box_hton(dst, dst);	/* Operate in-place */
 		break;
 
@@ -4,6 +4,7 @@ SUBMAKEFILES := \
     radsniff.mk \
     radmin.mk \
     radwho.mk \
+    raddetail.mk \
     radsnmp.mk \
     radlast.mk \
     radtest.mk \
@@ -592,31 +592,64 @@ authenticate:
 
 #include <freeradius-devel/io/listen.h>
 
-static rlm_rcode_t virtual_server_async(REQUEST *request, bool parent)
+static int virtual_server_child_cmp(void const *one, void const *two)
+{
+	return (one > two) - (one < two);
+}
+
+/** Convert the reply of a child request into an rcode
+ *
+ */
+static rlm_rcode_t virtual_server_async_rcode(REQUEST *request)
+{
+	if (!request->reply->code ||
+	    (request->reply->code == FR_CODE_ACCESS_REJECT)) {
+		return RLM_MODULE_REJECT;
+	}
+
+	if (request->reply->code == FR_CODE_ACCESS_CHALLENGE) {
+		return RLM_MODULE_HANDLED;
+	}
+
+	return RLM_MODULE_OK;
+}
+
+static rlm_rcode_t virtual_server_async(REQUEST *request, bool parent, bool may_yield)
 {
 	fr_io_final_t final;
 
 	if (parent) {
 		request->async = talloc_memdup(request, request->parent->async,
 					       sizeof(fr_async_t));
+
+		/*
+		 *	The child uses its parent's event list, but
+		 *	has a backlog of its own.  When the child is
+		 *	marked resumable, unlang_resumable() schedules
+		 *	the parent, which continues the child.
+		 */
+		if (may_yield) {
+			request->el = request->parent->el;
+			request->backlog = fr_heap_create(virtual_server_child_cmp, offsetof(REQUEST, heap_id));
+			if (!request->backlog) {
+				REDEBUG("Failed creating backlog for child request");
+				return RLM_MODULE_FAIL;
+			}
+			talloc_steal(request, request->backlog);
+		}
 	}
 
 	RDEBUG("server %s (async) {", cf_section_name2(request->server_cs));
 	final = request->async->process(request, FR_IO_ACTION_RUN);
+	if (may_yield && (final == FR_IO_YIELD)) {
+		RDEBUG("} # server %s (async) yielded", cf_section_name2(request->server_cs));
+		return RLM_MODULE_YIELD;
+	}
 	RDEBUG("} # server %s (async) ", cf_section_name2(request->server_cs));
 
 	rad_cond_assert(final == FR_IO_REPLY);
 
-	if (!request->reply->code ||
-	    (request->reply->code == FR_CODE_ACCESS_REJECT)) {
-		return RLM_MODULE_REJECT;
-	}
-
-	if (request->reply->code == FR_CODE_ACCESS_CHALLENGE) {
-		return RLM_MODULE_HANDLED;
-	}
-
-	return RLM_MODULE_OK;
+	return virtual_server_async_rcode(request);
 }
 
 
@@ -624,7 +657,7 @@ static rlm_rcode_t virtual_server_async(REQUEST *request, bool parent)
  *	Run a virtual server auth and postauth
  *
  */
-rlm_rcode_t rad_virtual_server(REQUEST *request)
+static rlm_rcode_t virtual_server_run(REQUEST *request, bool may_yield)
 {
 	VALUE_PAIR *vp;
 	int rcode;
@@ -727,9 +760,9 @@ rlm_rcode_t rad_virtual_server(REQUEST *request)
 	}
 
 skip:
-	if (request->async) return virtual_server_async(request, false);
+	if (request->async) return virtual_server_async(request, false, false);
 
-	if (request->parent && request->parent->async) return virtual_server_async(request, true);
+	if (request->parent && request->parent->async) return virtual_server_async(request, true, may_yield);
 
 	RDEBUG("server %s {", cf_section_name2(request->server_cs));
 
@@ -762,6 +795,68 @@ skip:
 	return rcode;
 }
 
+/** Run a child request through a virtual server, waiting for any events it needs
+ *
+ * @param[in] request	to run, as created by request_alloc_fake().
+ * @return the rcode of the virtual server.
+ */
+rlm_rcode_t rad_virtual_server(REQUEST *request)
+{
+	return virtual_server_run(request, false);
+}
+
+/** Run, or continue, a child request through a virtual server, allowing it to yield
+ *
+ * If the parent is being processed asynchronously, the modules of the
+ * child may yield.  The caller should then yield the parent, and call
+ * this function again when the parent is resumed.  The child is only
+ * continued if it has been marked resumable, so it's safe to call this
+ * function if the parent was resumed for another reason.
+ *
+ * @param[in] request	to run, as created by request_alloc_fake().
+ * @return
+ *	- RLM_MODULE_YIELD if the child is waiting for an event.
+ *	- The rcode of the virtual server.
+ */
+rlm_rcode_t rad_virtual_server_child(REQUEST *request)
+{
+	fr_io_final_t final;
+
+	if (!request->backlog || (request->request_state == REQUEST_INIT)) return virtual_server_run(request, true);
+
+	/*
+	 *	Still waiting.
+	 */
+	if (request->heap_id < 0) return RLM_MODULE_YIELD;
+	(void) fr_heap_extract(request->backlog, request);
+
+	RDEBUG("server %s (async) {", cf_section_name2(request->server_cs));
+	final = request->async->process(request, FR_IO_ACTION_RUN);
+	if (final == FR_IO_YIELD) {
+		RDEBUG("} # server %s (async) yielded", cf_section_name2(request->server_cs));
+		return RLM_MODULE_YIELD;
+	}
+	RDEBUG("} # server %s (async) ", cf_section_name2(request->server_cs));
+
+	rad_cond_assert(final == FR_IO_REPLY);
+
+	return virtual_server_async_rcode(request);
+}
+
+/** Stop a child request which yielded
+ *
+ * The modules of the child are signalled, so that they can stop
+ * waiting for their events.  The caller must still free the child.
+ *
+ * @param[in] request	which rad_virtual_server_child() returned RLM_MODULE_YIELD for.
+ */
+void rad_virtual_server_child_cancel(REQUEST *request)
+{
+	if (request->heap_id >= 0) (void) fr_heap_extract(request->backlog, request);
+
+	unlang_signal(request, FR_ACTION_DONE);
+}
+
 void common_packet_debug(REQUEST *request, RADIUS_PACKET *packet, bool received);
 
 /*
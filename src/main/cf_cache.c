@@ -0,0 +1,1022 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file cf_cache.c
+ * @brief Cache the parsed config, so it needn't be parsed again at startup.
+ *
+ * Large configurations, with hundreds of included files, spend most of
+ * the time it takes to start the server in the parser.  Once the files
+ * have been read, the tree of sections and pairs is written to a cache
+ * file, along with everything the tree was built from.  That's the
+ * name, inode, size, mtime and SHA1 digest of each config file, the
+ * directories which were included, the optional files which didn't
+ * exist, and the environment variables which were expanded.
+ *
+ * At the next startup, if none of those have changed, the tree is built
+ * from the cache instead.  A file whose timestamp has changed, but whose
+ * contents haven't, doesn't invalidate the cache.
+ *
+ * Only the tree is cached.  Conditions in "if" and "elsif" sections are
+ * tokenized again when the cache is loaded, because they refer to
+ * dictionary attributes.  Modules, virtual servers and unlang are
+ * compiled from the tree, as usual.
+ *
+ * The cache is written in host byte order, and is only ever read by the
+ * same version of the server, on the same host.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/parser.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <freeradius-devel/cf_file.h>
+#include "cf_priv.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define CF_CACHE_MAGIC		"FRCFC001"
+#define CF_CACHE_MAGIC_LEN	(sizeof(CF_CACHE_MAGIC) - 1)
+
+/*
+ *	Tree records.
+ */
+#define CF_CACHE_PAIR		'P'
+#define CF_CACHE_SECTION	'S'
+#define CF_CACHE_END		'E'	//!< Of the children of a section.
+
+#define CF_CACHE_NONE		UINT32_MAX	//!< A NULL string, or a missing index.
+
+typedef struct cf_cache_dep_s cf_cache_dep_t;
+
+/** Something other than a config file, which the parsed config depends on
+ *
+ */
+struct cf_cache_dep_s {
+	cf_cache_dep_type_t	type;		//!< Of dependency.
+	char const		*name;		//!< Of the directory, file or environment variable.
+	char const		*value;		//!< Of the environment variable, or NULL if it was unset.
+	struct stat		buf;		//!< Of the directory.
+	cf_cache_dep_t		*next;		//!< Next dependency.
+};
+
+/*
+ *	Only set while cf_file_read_cached() is parsing the
+ *	config.  The server reads its config from one thread.
+ */
+static TALLOC_CTX	*cf_cache_ctx;		//!< Holds the dependencies.  NULL when we're not recording.
+static cf_cache_dep_t	*cf_cache_deps;		//!< Recorded so far.
+static bool		cf_cache_unusable;	//!< A dependency couldn't be recorded.
+static time_t		cf_cache_started;	//!< When parsing started.
+
+/** A growing buffer holding the cache being written
+ *
+ */
+typedef struct {
+	uint8_t			*data;
+	size_t			len;
+} cf_cache_out_t;
+
+/** The cache being read
+ *
+ */
+typedef struct {
+	uint8_t const		*p;
+	uint8_t const		*end;
+} cf_cache_in_t;
+
+/** State for writing the cache
+ *
+ */
+typedef struct {
+	cf_cache_out_t		out;
+
+	CONF_SECTION		*root;		//!< Of the config.
+
+	cf_file_t		**files;	//!< Config files which were read.
+	uint32_t		num_files;
+	uint32_t		*file_section;	//!< Index of the section each file was included into.
+
+	char const		**names;	//!< Filenames of config items.
+	uint32_t		num_names;
+	uint32_t		last_name;	//!< Index of the last name we looked up.
+
+	uint32_t		num_sections;	//!< Sections written so far.
+} cf_cache_save_t;
+
+/** State for reading the cache
+ *
+ */
+typedef struct {
+	cf_cache_in_t		in;
+
+	char const		**names;	//!< Filenames of config items.
+	uint32_t		num_names;
+
+	CONF_SECTION		**sections;	//!< By the order they're written in.  0 is the root.
+	uint32_t		num_sections;
+	uint32_t		next_section;
+} cf_cache_load_t;
+
+/** Whether cf_file_read_cached() is recording the dependencies of the config
+ *
+ */
+bool cf_cache_recording(void)
+{
+	return (cf_cache_ctx != NULL);
+}
+
+/** Calculate the digest of a config file
+ *
+ * @param[out] digest	of the contents.
+ * @param[in] data	contents of the file.
+ * @param[in] len	of the contents.
+ */
+void cf_cache_digest(uint8_t digest[SHA1_DIGEST_LENGTH], uint8_t const *data, size_t len)
+{
+	fr_sha1_ctx ctx;
+
+	fr_sha1_init(&ctx);
+	fr_sha1_update(&ctx, data, len);
+	fr_sha1_final(digest, &ctx);
+}
+
+/** Record something the config depends on
+ *
+ * Does nothing unless cf_file_read_cached() is parsing the config.
+ *
+ * @param[in] type	of dependency.
+ * @param[in] name	of the directory, file, or environment variable.
+ * @param[in] value	of the environment variable.  NULL if it's unset.
+ */
+void cf_cache_dep_add(cf_cache_dep_type_t type, char const *name, char const *value)
+{
+	cf_cache_dep_t *dep;
+
+	if (!cf_cache_ctx) return;
+
+	for (dep = cf_cache_deps; dep; dep = dep->next) {
+		if ((dep->type == type) && (strcmp(dep->name, name) == 0)) return;
+	}
+
+	MEM(dep = talloc_zero(cf_cache_ctx, cf_cache_dep_t));
+	dep->type = type;
+	MEM(dep->name = talloc_typed_strdup(dep, name));
+	if (value) MEM(dep->value = talloc_typed_strdup(dep, value));
+
+	if ((type == CF_CACHE_DEP_DIRECTORY) && (stat(name, &dep->buf) < 0)) {
+		DEBUG2("Not caching configuration, failed reading directory %s: %s", name, fr_syserror(errno));
+		cf_cache_unusable = true;
+	}
+
+	dep->next = cf_cache_deps;
+	cf_cache_deps = dep;
+}
+
+static void cf_cache_put(cf_cache_out_t *out, void const *in, size_t inlen)
+{
+	size_t size = talloc_array_length(out->data);
+
+	if ((out->len + inlen) > size) {
+		size = (size * 2) + inlen;
+		MEM(out->data = talloc_realloc(NULL, out->data, uint8_t, size));
+	}
+
+	memcpy(out->data + out->len, in, inlen);
+	out->len += inlen;
+}
+
+static inline void cf_cache_put_uint8(cf_cache_out_t *out, uint8_t num)
+{
+	cf_cache_put(out, &num, sizeof(num));
+}
+
+static inline void cf_cache_put_uint32(cf_cache_out_t *out, uint32_t num)
+{
+	cf_cache_put(out, &num, sizeof(num));
+}
+
+static inline void cf_cache_put_uint64(cf_cache_out_t *out, uint64_t num)
+{
+	cf_cache_put(out, &num, sizeof(num));
+}
+
+/*
+ *	Length, then the string, including its \0.
+ */
+static void cf_cache_put_str(cf_cache_out_t *out, char const *str)
+{
+	size_t len;
+
+	if (!str) {
+		cf_cache_put_uint32(out, CF_CACHE_NONE);
+		return;
+	}
+
+	len = strlen(str);
+	cf_cache_put_uint32(out, len);
+	cf_cache_put(out, str, len + 1);
+}
+
+static void cf_cache_put_stat(cf_cache_out_t *out, struct stat const *buf)
+{
+	time_t mtime = buf->st_mtime;
+
+	/*
+	 *	Changes made in the same second as the file was
+	 *	read wouldn't change its mtime.  Make sure the file
+	 *	is checked properly next time.
+	 */
+	if (mtime >= (cf_cache_started - 1)) mtime = 0;
+
+	cf_cache_put_uint64(out, buf->st_dev);
+	cf_cache_put_uint64(out, buf->st_ino);
+	cf_cache_put_uint64(out, buf->st_size);
+	cf_cache_put_uint64(out, mtime);
+	cf_cache_put_uint32(out, buf->st_mode);
+}
+
+static bool cf_cache_get(cf_cache_in_t *in, void *out, size_t outlen)
+{
+	if ((size_t)(in->end - in->p) < outlen) return false;
+
+	memcpy(out, in->p, outlen);
+	in->p += outlen;
+
+	return true;
+}
+
+static inline bool cf_cache_get_uint8(cf_cache_in_t *in, uint8_t *num)
+{
+	return cf_cache_get(in, num, sizeof(*num));
+}
+
+static inline bool cf_cache_get_uint32(cf_cache_in_t *in, uint32_t *num)
+{
+	return cf_cache_get(in, num, sizeof(*num));
+}
+
+static inline bool cf_cache_get_uint64(cf_cache_in_t *in, uint64_t *num)
+{
+	return cf_cache_get(in, num, sizeof(*num));
+}
+
+/*
+ *	Strings point into the cache, they're copied when
+ *	they're added to the config.
+ */
+static bool cf_cache_get_str(cf_cache_in_t *in, char const **str)
+{
+	uint32_t len;
+
+	if (!cf_cache_get_uint32(in, &len)) return false;
+
+	if (len == CF_CACHE_NONE) {
+		*str = NULL;
+		return true;
+	}
+
+	if ((size_t)(in->end - in->p) <= len) return false;
+	if (in->p[len] != '\0') return false;
+
+	*str = (char const *) in->p;
+	in->p += len + 1;
+
+	return true;
+}
+
+static bool cf_cache_get_stat(cf_cache_in_t *in, struct stat *buf)
+{
+	uint64_t	dev, ino, size, mtime;
+	uint32_t	mode;
+
+	if (!cf_cache_get_uint64(in, &dev) ||
+	    !cf_cache_get_uint64(in, &ino) ||
+	    !cf_cache_get_uint64(in, &size) ||
+	    !cf_cache_get_uint64(in, &mtime) ||
+	    !cf_cache_get_uint32(in, &mode)) return false;
+
+	memset(buf, 0, sizeof(*buf));
+	buf->st_dev = dev;
+	buf->st_ino = ino;
+	buf->st_size = size;
+	buf->st_mtime = mtime;
+	buf->st_mode = mode;
+
+	return true;
+}
+
+static inline bool cf_cache_stat_cmp(struct stat const *a, struct stat const *b)
+{
+	return ((a->st_dev == b->st_dev) &&
+		(a->st_ino == b->st_ino) &&
+		(a->st_size == b->st_size) &&
+		(a->st_mtime == b->st_mtime) &&
+		(a->st_mode == b->st_mode));
+}
+
+/** Map the name of the file an item came from to its index
+ *
+ * Consecutive items nearly always come from the same file.
+ */
+static uint32_t cf_cache_name_index(cf_cache_save_t *save, char const *name)
+{
+	uint32_t i;
+
+	if (!name) return CF_CACHE_NONE;
+
+	if ((save->last_name < save->num_names) &&
+	    ((save->names[save->last_name] == name) || (strcmp(save->names[save->last_name], name) == 0))) {
+		return save->last_name;
+	}
+
+	for (i = 0; i < save->num_names; i++) {
+		if (strcmp(save->names[i], name) == 0) goto done;
+	}
+
+	if (save->num_names == talloc_array_length(save->names)) {
+		MEM(save->names = talloc_realloc(save, save->names, char const *, (save->num_names * 2) + 16));
+	}
+	save->names[save->num_names++] = name;
+
+done:
+	save->last_name = i;
+	return i;
+}
+
+static int _cf_cache_file_add(void *ctx, void *data)
+{
+	cf_cache_save_t	*save = ctx;
+	cf_file_t	*file = data;
+
+	/*
+	 *	Only files added by cf_file_check() haven't been
+	 *	digested, and they're not part of the config.
+	 */
+	if (!file->digested) return 0;
+
+	save->files[save->num_files] = file;
+	save->file_section[save->num_files] = (file->cs == save->root) ? 0 : CF_CACHE_NONE;
+	save->num_files++;
+
+	(void) cf_cache_name_index(save, file->filename);
+
+	return 0;
+}
+
+/** Write a list of config items, and their children
+ *
+ * Data isn't written.  It's either private to whatever added it, or
+ * recreated when the cache is loaded.  Comments and includes aren't
+ * written either.
+ */
+static void cf_cache_save_items(cf_cache_save_t *save, CONF_ITEM *ci)
+{
+	cf_cache_out_t	*out = &save->out;
+	uint32_t	i;
+
+	for (; ci; ci = ci->next) {
+		switch (ci->type) {
+		case CONF_ITEM_PAIR:
+		{
+			CONF_PAIR *cp = cf_item_to_pair(ci);
+
+			cf_cache_put_uint8(out, CF_CACHE_PAIR);
+			cf_cache_put_str(out, cp->attr);
+			cf_cache_put_str(out, cp->value);
+			cf_cache_put_uint32(out, cp->op);
+			cf_cache_put_uint32(out, cp->lhs_quote);
+			cf_cache_put_uint32(out, cp->rhs_quote);
+			cf_cache_put_uint8(out, cp->pass2);
+			cf_cache_put_uint32(out, cf_cache_name_index(save, ci->filename));
+			cf_cache_put_uint32(out, ci->lineno);
+		}
+			break;
+
+		case CONF_ITEM_SECTION:
+		{
+			CONF_SECTION	*cs = cf_item_to_section(ci);
+			uint32_t	index = ++save->num_sections;
+			int		j;
+
+			for (i = 0; i < save->num_files; i++) {
+				if (save->files[i]->cs == cs) save->file_section[i] = index;
+			}
+
+			cf_cache_put_uint8(out, CF_CACHE_SECTION);
+			cf_cache_put_str(out, cs->name1);
+			cf_cache_put_str(out, cs->name2);
+			cf_cache_put_uint32(out, cs->name2_quote);
+			cf_cache_put_uint32(out, cs->argc);
+			for (j = 0; j < cs->argc; j++) {
+				cf_cache_put_str(out, cs->argv[j]);
+				cf_cache_put_uint32(out, cs->argv_quote[j]);
+			}
+			cf_cache_put_uint32(out, cf_cache_name_index(save, ci->filename));
+			cf_cache_put_uint32(out, ci->lineno);
+
+			cf_cache_save_items(save, ci->child);
+		}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	cf_cache_put_uint8(out, CF_CACHE_END);
+}
+
+/** Write the cache
+ *
+ * Failing to write the cache isn't fatal.  The config will be parsed
+ * again at the next startup.
+ *
+ * @param[in] cs		the root of the config.
+ * @param[in] first		item added by the parser.
+ * @param[in] filename		of the main config file.
+ * @param[in] cache_file	to write.
+ */
+static void cf_cache_save(CONF_SECTION *cs, CONF_ITEM *first, char const *filename, char const *cache_file)
+{
+	cf_cache_save_t		*save;
+	cf_cache_out_t		head, *out = &head;
+	cf_cache_dep_t		*dep;
+	rbtree_t		*tree;
+	uint32_t		i, num_deps = 0;
+	uint8_t			digest[SHA1_DIGEST_LENGTH];
+	char			*tmp;
+	int			fd;
+	size_t			done;
+	ssize_t			slen = 0;
+
+	tree = cf_data_value(cf_data_find(cs, rbtree_t, "filename"));
+	if (!tree) return;
+
+	MEM(save = talloc_zero(NULL, cf_cache_save_t));
+	save->root = cs;
+	MEM(save->files = talloc_array(save, cf_file_t *, rbtree_num_elements(tree)));
+	MEM(save->file_section = talloc_array(save, uint32_t, rbtree_num_elements(tree)));
+	MEM(save->out.data = talloc_array(save, uint8_t, 65536));
+
+	(void) rbtree_walk(tree, RBTREE_IN_ORDER, _cf_cache_file_add, save);
+
+	/*
+	 *	The tree goes last, but we need to know which sections
+	 *	the files were included into first.
+	 */
+	cf_cache_save_items(save, first);
+
+	MEM(head.data = talloc_array(save, uint8_t, 65536));
+	head.len = 0;
+
+	cf_cache_put(out, CF_CACHE_MAGIC, CF_CACHE_MAGIC_LEN);
+	cf_cache_put_str(out, RADIUSD_VERSION_STRING);
+	cf_cache_put_str(out, filename);
+
+	cf_cache_put_uint32(out, save->num_names);
+	for (i = 0; i < save->num_names; i++) cf_cache_put_str(out, save->names[i]);
+
+	cf_cache_put_uint32(out, save->num_files);
+	for (i = 0; i < save->num_files; i++) {
+		cf_cache_put_uint32(out, cf_cache_name_index(save, save->files[i]->filename));
+		cf_cache_put_stat(out, &save->files[i]->buf);
+		cf_cache_put(out, save->files[i]->digest, SHA1_DIGEST_LENGTH);
+		cf_cache_put_uint32(out, save->file_section[i]);
+	}
+
+	for (dep = cf_cache_deps; dep; dep = dep->next) num_deps++;
+	cf_cache_put_uint32(out, num_deps);
+	for (dep = cf_cache_deps; dep; dep = dep->next) {
+		cf_cache_put_uint32(out, dep->type);
+		cf_cache_put_str(out, dep->name);
+		cf_cache_put_str(out, dep->value);
+		if (dep->type == CF_CACHE_DEP_DIRECTORY) cf_cache_put_stat(out, &dep->buf);
+	}
+
+	cf_cache_put_uint32(out, save->num_sections);
+	cf_cache_put(out, save->out.data, save->out.len);
+
+	cf_cache_digest(digest, out->data, out->len);
+	cf_cache_put(out, digest, sizeof(digest));
+
+	/*
+	 *	Write a temporary file, and rename it, so the server
+	 *	never sees half a cache.
+	 */
+	MEM(tmp = talloc_asprintf(save, "%s.%u", cache_file, (unsigned int) getpid()));
+
+	(void) unlink(tmp);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		WARN("Failed writing configuration cache %s: %s", tmp, fr_syserror(errno));
+		goto finish;
+	}
+
+	for (done = 0; done < out->len; done += slen) {
+		slen = write(fd, out->data + done, out->len - done);
+		if (slen < 0) {
+			if (errno == EINTR) {
+				slen = 0;
+				continue;
+			}
+
+			WARN("Failed writing configuration cache %s: %s", tmp, fr_syserror(errno));
+			close(fd);
+			goto error;
+		}
+	}
+
+	if (close(fd) < 0) {
+		WARN("Failed writing configuration cache %s: %s", tmp, fr_syserror(errno));
+		goto error;
+	}
+
+	if (rename(tmp, cache_file) < 0) {
+		WARN("Failed renaming %s to %s: %s", tmp, cache_file, fr_syserror(errno));
+	error:
+		unlink(tmp);
+		goto finish;
+	}
+
+	DEBUG2("Wrote configuration cache %s (%u files, %u sections)", cache_file,
+	       save->num_files, save->num_sections);
+
+finish:
+	talloc_free(save);
+}
+
+/** Check a config file hasn't changed since the cache was written
+ *
+ * @param[out] buf	the file's current stat.
+ * @param[in] filename	of the config file.
+ * @param[in] cached	stat of the file when it was read.
+ * @param[in] digest	of the file when it was read.
+ * @return
+ *	- true if the file is unchanged.
+ *	- false if it's changed.
+ */
+static bool cf_cache_file_valid(struct stat *buf, char const *filename,
+				struct stat const *cached, uint8_t const digest[SHA1_DIGEST_LENGTH])
+{
+	uint8_t		current[SHA1_DIGEST_LENGTH];
+	void		*map;
+	int		fd;
+
+	if (stat(filename, buf) < 0) return false;
+
+	/*
+	 *	The parser produces a much better error.
+	 */
+#ifdef S_IWOTH
+	if ((buf->st_mode & S_IWOTH) != 0) return false;
+#endif
+
+	if (cf_cache_stat_cmp(buf, cached)) return true;
+
+	/*
+	 *	The timestamp has changed, maybe the contents
+	 *	haven't.
+	 */
+	if (!S_ISREG(buf->st_mode) || (buf->st_size != cached->st_size)) return false;
+	if (buf->st_size == 0) return true;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) return false;
+
+	map = mmap(NULL, buf->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return false;
+
+	cf_cache_digest(current, map, buf->st_size);
+	munmap(map, buf->st_size);
+
+	return (memcmp(current, digest, SHA1_DIGEST_LENGTH) == 0);
+}
+
+/** Build config items from the cache
+ *
+ * @param[in] load	state.
+ * @param[in] parent	to add the items to.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the cache is corrupt, or a condition no longer parses.
+ */
+static int cf_cache_load_items(cf_cache_load_t *load, CONF_SECTION *parent)
+{
+	cf_cache_in_t *in = &load->in;
+
+	for (;;) {
+		uint8_t		type;
+		char const	*name1, *name2;
+		uint32_t	op, lhs_quote, rhs_quote, name, lineno;
+
+		if (!cf_cache_get_uint8(in, &type)) return -1;
+
+		switch (type) {
+		case CF_CACHE_END:
+			return 0;
+
+		case CF_CACHE_PAIR:
+		{
+			CONF_PAIR	*cp;
+			uint8_t		pass2;
+
+			if (!cf_cache_get_str(in, &name1) ||
+			    !cf_cache_get_str(in, &name2) ||
+			    !cf_cache_get_uint32(in, &op) ||
+			    !cf_cache_get_uint32(in, &lhs_quote) ||
+			    !cf_cache_get_uint32(in, &rhs_quote) ||
+			    !cf_cache_get_uint8(in, &pass2) ||
+			    !cf_cache_get_uint32(in, &name) ||
+			    !cf_cache_get_uint32(in, &lineno)) return -1;
+
+			if (!name1 || (op >= T_TOKEN_LAST) || !(fr_equality_op[op] || fr_assignment_op[op])) return -1;
+			if ((name != CF_CACHE_NONE) && (name >= load->num_names)) return -1;
+
+			cp = cf_pair_alloc(parent, name1, name2, op, lhs_quote, rhs_quote);
+			if (!cp) return -1;
+
+			cp->pass2 = (pass2 != 0);
+			if (name != CF_CACHE_NONE) cp->item.filename = load->names[name];
+			cp->item.lineno = lineno;
+
+			cf_item_add(parent, &(cp->item));
+		}
+			break;
+
+		case CF_CACHE_SECTION:
+		{
+			CONF_SECTION	*cs;
+			uint32_t	name2_quote, argc, i;
+
+			if (!cf_cache_get_str(in, &name1) ||
+			    !cf_cache_get_str(in, &name2) ||
+			    !cf_cache_get_uint32(in, &name2_quote) ||
+			    !cf_cache_get_uint32(in, &argc)) return -1;
+
+			if (!name1 || (load->next_section > load->num_sections)) return -1;
+
+			/*
+			 *	No parent, so that name2 isn't expanded
+			 *	a second time.
+			 */
+			cs = cf_section_alloc(parent, NULL, name1, NULL);
+			if (!cs) return -1;
+
+			cs->item.parent = cf_section_to_item(parent);
+			cs->depth = parent->depth + 1;
+			if (name2) MEM(cs->name2 = talloc_typed_strdup(cs, name2));
+			cs->name2_quote = name2_quote;
+
+			if (argc > 0) {
+				if (argc > (uint32_t)(in->end - in->p)) {
+				section_error:
+					talloc_free(cs);
+					return -1;
+				}
+
+				MEM(cs->argv = talloc_array(cs, char const *, argc));
+				MEM(cs->argv_quote = talloc_array(cs, FR_TOKEN, argc));
+
+				for (i = 0; i < argc; i++) {
+					char const	*arg;
+					uint32_t	quote;
+
+					if (!cf_cache_get_str(in, &arg) ||
+					    !cf_cache_get_uint32(in, &quote) || !arg) goto section_error;
+
+					MEM(cs->argv[i] = talloc_typed_strdup(cs->argv, arg));
+					cs->argv_quote[i] = quote;
+				}
+				cs->argc = argc;
+			}
+
+			if (!cf_cache_get_uint32(in, &name) ||
+			    !cf_cache_get_uint32(in, &lineno)) goto section_error;
+			if ((name != CF_CACHE_NONE) && (name >= load->num_names)) goto section_error;
+
+			if (name != CF_CACHE_NONE) cs->item.filename = load->names[name];
+			cs->item.lineno = lineno;
+
+			if (cs->name2 &&
+			    ((strcmp(cs->name1, "if") == 0) || (strcmp(cs->name1, "elsif") == 0))) {
+				fr_cond_t	*cond;
+				char const	*error = NULL;
+
+				if (fr_cond_tokenize(cs, cf_section_to_item(cs), cs->name2, &cond,
+						     &error, FR_COND_TWO_PASS) < 0) {
+					DEBUG2("Not using configuration cache, condition at %s[%d] no longer parses: %s",
+					       cs->item.filename, cs->item.lineno, error);
+					goto section_error;
+				}
+
+				cf_data_add(cs, cond, NULL, false);
+			}
+
+			cf_item_add(parent, &(cs->item));
+			load->sections[load->next_section++] = cs;
+
+			if (cf_cache_load_items(load, cs) < 0) return -1;
+		}
+			break;
+
+		default:
+			return -1;
+		}
+	}
+}
+
+/** Build the config from the cache, if the cache is still valid
+ *
+ * @param[in] cs		the root of the config.
+ * @param[in] filename		of the main config file.
+ * @param[in] cache_file	to read.
+ * @return
+ *	- true if the config was built from the cache.
+ *	- false if the config must be parsed.
+ */
+static bool cf_cache_load(CONF_SECTION *cs, char const *filename, char const *cache_file)
+{
+	cf_cache_load_t		*load;
+	cf_cache_in_t		*in;
+	CONF_SECTION		*scratch;
+	CONF_ITEM		*ci;
+	rbtree_t		*tree;
+	TALLOC_CTX		*names_ctx;
+	struct stat		buf;
+	void			*map;
+	uint8_t const		*files;
+	uint8_t			digest[SHA1_DIGEST_LENGTH];
+	char			magic[CF_CACHE_MAGIC_LEN];
+	char const		*version, *cached_filename;
+	uint32_t		num_files, num_deps, i;
+	int			fd;
+	bool			ret = false;
+
+	fd = open(cache_file, O_RDONLY);
+	if (fd < 0) {
+		DEBUG2("Not using configuration cache %s: %s", cache_file, fr_syserror(errno));
+		return false;
+	}
+
+	if (fstat(fd, &buf) < 0) {
+		close(fd);
+		return false;
+	}
+
+#ifdef S_IWOTH
+	if ((buf.st_mode & S_IWOTH) != 0) {
+		WARN("Not using configuration cache %s, it is globally writable", cache_file);
+		close(fd);
+		return false;
+	}
+#endif
+
+	if (!S_ISREG(buf.st_mode) || ((size_t) buf.st_size < (CF_CACHE_MAGIC_LEN + SHA1_DIGEST_LENGTH))) {
+		close(fd);
+		return false;
+	}
+
+	map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return false;
+
+	MEM(load = talloc_zero(NULL, cf_cache_load_t));
+	in = &load->in;
+	in->p = map;
+	in->end = in->p + buf.st_size - SHA1_DIGEST_LENGTH;
+
+	cf_cache_digest(digest, in->p, in->end - in->p);
+	if (memcmp(digest, in->end, SHA1_DIGEST_LENGTH) != 0) {
+		DEBUG2("Not using configuration cache %s, it is corrupt", cache_file);
+		goto finish;
+	}
+
+	if (!cf_cache_get(in, magic, sizeof(magic)) ||
+	    (memcmp(magic, CF_CACHE_MAGIC, CF_CACHE_MAGIC_LEN) != 0) ||
+	    !cf_cache_get_str(in, &version) || !version ||
+	    (strcmp(version, RADIUSD_VERSION_STRING) != 0)) {
+		DEBUG2("Not using configuration cache %s, it was written by a different version of the server",
+		       cache_file);
+		goto finish;
+	}
+
+	if (!cf_cache_get_str(in, &cached_filename) || !cached_filename ||
+	    (strcmp(cached_filename, filename) != 0)) {
+		DEBUG2("Not using configuration cache %s, it is for a different configuration", cache_file);
+		goto finish;
+	}
+
+	/*
+	 *	Names are copied into the config, as the parser
+	 *	would have.
+	 */
+	if (!cf_cache_get_uint32(in, &load->num_names) ||
+	    (load->num_names > (uint32_t)(in->end - in->p))) {
+	corrupt:
+		DEBUG2("Not using configuration cache %s, it is corrupt", cache_file);
+		goto finish;
+	}
+
+	MEM(load->names = talloc_array(load, char const *, load->num_names));
+	for (i = 0; i < load->num_names; i++) {
+		if (!cf_cache_get_str(in, &load->names[i]) || !load->names[i]) goto corrupt;
+	}
+
+	/*
+	 *	Check the files, and everything else we depend on,
+	 *	before building anything.
+	 */
+	if (!cf_cache_get_uint32(in, &num_files)) goto corrupt;
+	files = in->p;
+
+	for (i = 0; i < num_files; i++) {
+		uint32_t	name, section;
+		struct stat	cached, current;
+		uint8_t		file_digest[SHA1_DIGEST_LENGTH];
+
+		if (!cf_cache_get_uint32(in, &name) ||
+		    !cf_cache_get_stat(in, &cached) ||
+		    !cf_cache_get(in, file_digest, sizeof(file_digest)) ||
+		    !cf_cache_get_uint32(in, &section) ||
+		    (name >= load->num_names)) goto corrupt;
+
+		if (!cf_cache_file_valid(&current, load->names[name], &cached, file_digest)) {
+			DEBUG2("Not using configuration cache %s, %s has changed", cache_file, load->names[name]);
+			goto finish;
+		}
+	}
+
+	if (!cf_cache_get_uint32(in, &num_deps)) goto corrupt;
+
+	for (i = 0; i < num_deps; i++) {
+		uint32_t	type;
+		char const	*name, *value, *env;
+		struct stat	cached, current;
+
+		if (!cf_cache_get_uint32(in, &type) ||
+		    !cf_cache_get_str(in, &name) || !name ||
+		    !cf_cache_get_str(in, &value)) goto corrupt;
+
+		switch (type) {
+		case CF_CACHE_DEP_DIRECTORY:
+			if (!cf_cache_get_stat(in, &cached)) goto corrupt;
+
+			if ((stat(name, &current) < 0) || !cf_cache_stat_cmp(&current, &cached)) {
+				DEBUG2("Not using configuration cache %s, directory %s has changed",
+				       cache_file, name);
+				goto finish;
+			}
+			break;
+
+		case CF_CACHE_DEP_MISSING:
+			if (stat(name, &current) == 0) {
+				DEBUG2("Not using configuration cache %s, %s now exists", cache_file, name);
+				goto finish;
+			}
+			break;
+
+		case CF_CACHE_DEP_ENV:
+			env = getenv(name);
+			if ((!env != !value) || (env && (strcmp(env, value) != 0))) {
+				DEBUG2("Not using configuration cache %s, environment variable %s has changed",
+				       cache_file, name);
+				goto finish;
+			}
+			break;
+
+		default:
+			goto corrupt;
+		}
+	}
+
+	if (!cf_cache_get_uint32(in, &load->num_sections) ||
+	    (load->num_sections > (uint32_t)(in->end - in->p))) goto corrupt;
+
+	MEM(load->sections = talloc_zero_array(load, CONF_SECTION *, load->num_sections + 1));
+	load->sections[0] = cs;
+	load->next_section = 1;
+
+	/*
+	 *	Build the tree off to the side, so there's
+	 *	nothing to undo if it fails.
+	 */
+	MEM(scratch = cf_section_alloc(load, NULL, "main", NULL));
+
+	/*
+	 *	The names need to outlive the cache.
+	 */
+	MEM(names_ctx = talloc_new(load));
+	for (i = 0; i < load->num_names; i++) MEM(load->names[i] = talloc_typed_strdup(names_ctx, load->names[i]));
+
+	if ((cf_cache_load_items(load, scratch) < 0) || (in->p != in->end) ||
+	    (load->next_section != (load->num_sections + 1))) {
+		DEBUG2("Not using configuration cache %s", cache_file);
+		goto finish;
+	}
+
+	/*
+	 *	Move the items to the real config.
+	 */
+	talloc_steal(cs, names_ctx);
+	while ((ci = scratch->item.child)) {
+		scratch->item.child = ci->next;
+		ci->next = NULL;
+		ci->parent = cf_section_to_item(cs);
+		talloc_steal(cs, ci);
+		cf_item_add(cs, ci);
+	}
+
+	/*
+	 *	Remember the files, so we notice when they
+	 *	change on HUP.
+	 */
+	MEM(tree = rbtree_create(cs, cf_file_cmp, NULL, 0));
+	cf_data_add(cs, tree, "filename", false);
+
+	in->p = files;
+	for (i = 0; i < num_files; i++) {
+		cf_file_t	*file;
+		uint32_t	name, section;
+		struct stat	cached;
+
+		MEM(file = talloc_zero(tree, cf_file_t));
+
+		(void) cf_cache_get_uint32(in, &name);
+		(void) cf_cache_get_stat(in, &cached);
+		(void) cf_cache_get(in, file->digest, sizeof(file->digest));
+		(void) cf_cache_get_uint32(in, &section);
+
+		file->filename = load->names[name];
+		file->cs = (section <= load->num_sections) ? load->sections[section] : cs;
+		file->digested = true;
+
+		if ((stat(file->filename, &file->buf) < 0) || !rbtree_insert(tree, file)) talloc_free(file);
+	}
+
+	if (!cs->item.filename) cs->item.filename = talloc_typed_strdup(cs, filename);
+
+	DEBUG("Read configuration from cache %s", cache_file);
+	ret = true;
+
+finish:
+	munmap(map, buf.st_size);
+	talloc_free(load);
+
+	return ret;
+}
+
+/** Read a config file, or build it from the cache
+ *
+ * Works like cf_file_read().  If the cache is missing, or anything
+ * the config was built from has changed, the config is parsed, and
+ * the cache is written again.
+ *
+ * @param[in] cs		to add the config to.
+ * @param[in] filename		of the main config file.
+ * @param[in] cache_file	to read and write.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cf_file_read_cached(CONF_SECTION *cs, char const *filename, char const *cache_file)
+{
+	CONF_ITEM	*ci, *last = NULL;
+	int		ret;
+
+	if (cf_cache_load(cs, filename, cache_file)) return 0;
+
+	for (ci = cs->item.child; ci; ci = ci->next) last = ci;
+
+	MEM(cf_cache_ctx = talloc_new(NULL));
+	cf_cache_deps = NULL;
+	cf_cache_unusable = false;
+	cf_cache_started = time(NULL);
+
+	ret = cf_file_read(cs, filename);
+	if ((ret == 0) && !cf_cache_unusable) cf_cache_save(cs, last ? last->next : cs->item.child, filename, cache_file);
+
+	TALLOC_FREE(cf_cache_ctx);
+	cf_cache_deps = NULL;
+
+	return ret;
+}
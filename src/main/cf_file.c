@@ -53,6 +53,7 @@ RCSID("$Id$")
 
 #include <ctype.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 bool check_config = false;
 static uid_t conf_check_uid = (uid_t)-1;
@@ -287,6 +288,7 @@ char const *cf_expand_variables(char const *cf, int *lineno,
 			 *	If none exists, then make it an empty string.
 			 */
 			env = getenv(name);
+			cf_cache_dep_add(CF_CACHE_DEP_ENV, name, env);
 			if (env == NULL) {
 				*name = '\0';
 				env = name;
@@ -407,7 +409,7 @@ static bool cf_template_merge(CONF_SECTION *cs, CONF_SECTION const *template)
 /*
  *	Functions for tracking filenames.
  */
-static int _filename_cmp(void const *a, void const *b)
+int cf_file_cmp(void const *a, void const *b)
 {
 	cf_file_t const *one = a, *two = b;
 	int ret;
@@ -418,42 +420,176 @@ static int _filename_cmp(void const *a, void const *b)
 	return (one->buf.st_ino < two->buf.st_ino) - (one->buf.st_ino > two->buf.st_ino);
 }
 
-static FILE *cf_file_open(CONF_SECTION *cs, char const *filename)
+/** The contents of a config file, which is read a line at a time
+ *
+ * Regular files are mapped, instead of being read through stdio.  The
+ * parser copies each line out of the mapping, so it can tokenize it in
+ * place, but there's no per-line locking, or refilling of buffers.
+ */
+typedef struct {
+	uint8_t const	*data;		//!< The contents of the file.
+	size_t		len;		//!< Of the contents.
+	size_t		offset;		//!< Of the next line.
+	bool		mapped;		//!< Whether data is mmap()d, or talloced.
+} cf_stream_t;
+
+static int _cf_stream_free(cf_stream_t *stream)
+{
+	void *map;
+
+	if (!stream->mapped) return 0;
+
+	memcpy(&map, &stream->data, sizeof(map));
+	munmap(map, stream->len);
+
+	return 0;
+}
+
+/** Read the whole of a file which can't be mapped
+ *
+ */
+static int cf_stream_read(cf_stream_t *stream, int fd)
+{
+	uint8_t	*data;
+	size_t	len = 0, size = 8192;
+	ssize_t	slen;
+
+	MEM(data = talloc_array(stream, uint8_t, size));
+
+	for (;;) {
+		if (len == size) {
+			size *= 2;
+			MEM(data = talloc_realloc(stream, data, uint8_t, size));
+		}
+
+		slen = read(fd, data + len, size - len);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (slen == 0) break;
+
+		len += slen;
+	}
+
+	stream->data = data;
+	stream->len = len;
+
+	return 0;
+}
+
+/** Copy the next line of a file into a buffer
+ *
+ * Works like fgets().  The line is truncated if it doesn't fit, and
+ * the rest of it is returned by the next call.
+ *
+ * @param[out] buffer	to copy the line into.  Is always \0 terminated.
+ * @param[in] size	of the buffer.
+ * @param[in] stream	to read from.
+ * @return
+ *	- buffer.
+ *	- NULL at the end of the file.
+ */
+static char *cf_stream_gets(char *buffer, size_t size, cf_stream_t *stream)
+{
+	uint8_t const	*start, *eol;
+	size_t		len;
+
+	if ((stream->offset >= stream->len) || (size < 2)) return NULL;
+
+	start = stream->data + stream->offset;
+	len = stream->len - stream->offset;
+	if (len > (size - 1)) len = size - 1;
+
+	eol = memchr(start, '\n', len);
+	if (eol) len = (eol - start) + 1;
+
+	memcpy(buffer, start, len);
+	buffer[len] = '\0';
+	stream->offset += len;
+
+	return buffer;
+}
+
+static inline bool cf_stream_eof(cf_stream_t const *stream)
 {
-	cf_file_t *file;
-	CONF_SECTION *top;
-	rbtree_t *tree;
-	int fd;
-	FILE *fp;
+	return (stream->offset >= stream->len);
+}
+
+static cf_stream_t *cf_file_open(CONF_SECTION *cs, char const *filename)
+{
+	cf_file_t	*file;
+	CONF_SECTION	*top;
+	rbtree_t	*tree;
+	int		fd;
+	cf_stream_t	*stream;
 
 	top = cf_root(cs);
 	tree = cf_data_value(cf_data_find(top, rbtree_t, "filename"));
 	rad_assert(tree);
 
-	fp = fopen(filename, "r");
-	if (!fp) {
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
 		ERROR("Unable to open file \"%s\": %s", filename, fr_syserror(errno));
 		return NULL;
 	}
 
-	fd = fileno(fp);
-
 	MEM(file = talloc(tree, cf_file_t));
 
 	file->filename = filename;
 	file->cs = cs;
+	file->digested = false;
+
+	if (fstat(fd, &file->buf) < 0) {
+		ERROR("Unable to stat file \"%s\": %s", filename, fr_syserror(errno));
+	error:
+		close(fd);
+		talloc_free(file);
+		return NULL;
+	}
 
-	if (fstat(fd, &file->buf) == 0) {
 #ifdef S_IWOTH
-		if ((file->buf.st_mode & S_IWOTH) != 0) {
-			ERROR("Configuration file %s is globally writable.  "
-			      "Refusing to start due to insecure configuration.", filename);
+	if ((file->buf.st_mode & S_IWOTH) != 0) {
+		ERROR("Configuration file %s is globally writable.  "
+		      "Refusing to start due to insecure configuration.", filename);
+		goto error;
+	}
+#endif
 
-			fclose(fp);
-			talloc_free(file);
-			return NULL;
-		}
+	MEM(stream = talloc_zero(cs, cf_stream_t));
+
+	/*
+	 *	Pipes and the like are read the old way.
+	 */
+	if (S_ISREG(file->buf.st_mode) && (file->buf.st_size > 0)) {
+		void *map;
+
+		map = mmap(NULL, file->buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+			(void) madvise(map, file->buf.st_size, MADV_SEQUENTIAL);
 #endif
+			stream->data = map;
+			stream->len = file->buf.st_size;
+			stream->mapped = true;
+			talloc_set_destructor(stream, _cf_stream_free);
+		}
+	}
+
+	if (!stream->mapped && (cf_stream_read(stream, fd) < 0)) {
+		ERROR("Unable to read file \"%s\": %s", filename, fr_syserror(errno));
+		talloc_free(stream);
+		goto error;
+	}
+	close(fd);
+
+	/*
+	 *	The cache checks the contents of files whose
+	 *	timestamps have changed.
+	 */
+	if (cf_cache_recording()) {
+		cf_cache_digest(file->digest, stream->data, stream->len);
+		file->digested = true;
 	}
 
 	/*
@@ -464,7 +600,7 @@ static FILE *cf_file_open(CONF_SECTION *cs, char const *filename)
 	 */
 	if (!rbtree_insert(tree, file)) talloc_free(file);
 
-	return fp;
+	return stream;
 }
 
 /** Do some checks on the file as an "input" file.  i.e. one read by a module.
@@ -495,6 +631,7 @@ bool cf_file_check(CONF_SECTION *cs, char const *filename, bool check_perms)
 
 	file->filename = filename;
 	file->cs = cs;
+	file->digested = false;
 
 	if (!check_perms) {
 		if (stat(filename, &file->buf) < 0) {
@@ -736,7 +873,7 @@ static void cf_include_add(CONF_SECTION *cs, char const *filename, CONF_INCLUDE_
 /*
  *	Read a part of the config file.
  */
-static int cf_section_read(char const *filename, int *lineno, FILE *fp,
+static int cf_section_read(char const *filename, int *lineno, cf_stream_t *stream,
 			   CONF_SECTION *current, char *buff[7])
 
 {
@@ -768,7 +905,7 @@ static int cf_section_read(char const *filename, int *lineno, FILE *fp,
 		/*
 		 *	Get data, and remember if we are at EOF.
 		 */
-		at_eof = (fgets(cbuff, talloc_array_length(buff[0]) - (cbuff - buff[0]), fp) == NULL);
+		at_eof = (cf_stream_gets(cbuff, talloc_array_length(buff[0]) - (cbuff - buff[0]), stream) == NULL);
 		(*lineno)++;
 
 		/*
@@ -1005,6 +1142,12 @@ static int cf_section_read(char const *filename, int *lineno, FILE *fp,
 					goto error;
 				}
 
+				/*
+				 *	Files added to, or removed from the
+				 *	directory change its timestamp.
+				 */
+				cf_cache_dep_add(CF_CACHE_DEP_DIRECTORY, my_directory, NULL);
+
 				/*
 				 *	Read the directory, ignoring "." files.
 				 */
@@ -1052,6 +1195,7 @@ static int cf_section_read(char const *filename, int *lineno, FILE *fp,
 
 					if (stat(value, &statbuf) < 0) {
 						WARN("Not including file %s: %s", value, fr_syserror(errno));
+						cf_cache_dep_add(CF_CACHE_DEP_MISSING, value, NULL);
 						continue;
 					}
 				}
@@ -1559,7 +1703,7 @@ static int cf_section_read(char const *filename, int *lineno, FILE *fp,
 	/*
 	 *	See if EOF was unexpected ..
 	 */
-	if (feof(fp) && (this != current)) {
+	if (cf_stream_eof(stream) && (this != current)) {
 		ERROR("%s[%d]: EOF reached without closing brace for section %s starting at line %d",
 		      filename, *lineno, cf_section_name1(this), cf_lineno(this));
 		goto error;
@@ -1577,7 +1721,7 @@ static int cf_file_include(CONF_SECTION *cs, char const *filename_in,
 #endif
 			   CONF_INCLUDE_TYPE file_type, char *buff[7])
 {
-	FILE		*fp;
+	cf_stream_t	*stream;
 	int		lineno = 0;
 	char const	*filename;
 
@@ -1588,8 +1732,8 @@ static int cf_file_include(CONF_SECTION *cs, char const *filename_in,
 
 	DEBUG2("Including configuration file \"%s\"", filename);
 
-	fp = cf_file_open(cs, filename);
-	if (!fp) return -1;
+	stream = cf_file_open(cs, filename);
+	if (!stream) return -1;
 
 	if (!cs->item.filename) cs->item.filename = filename;
 
@@ -1605,9 +1749,9 @@ static int cf_file_include(CONF_SECTION *cs, char const *filename_in,
 	 *	Read the section.  It's OK to have EOF without a
 	 *	matching close brace.
 	 */
-	if (cf_section_read(filename, &lineno, fp, cs, buff) < 0) {
+	if (cf_section_read(filename, &lineno, stream, cs, buff) < 0) {
 		ERROR("Failed parsing configuration file \"%s\"", filename);
-		fclose(fp);
+		talloc_free(stream);
 		return -1;
 	}
 
@@ -1619,7 +1763,7 @@ static int cf_file_include(CONF_SECTION *cs, char const *filename_in,
 	cf_include_add(cs, NULL, file_type);
 #endif
 
-	fclose(fp);
+	talloc_free(stream);
 	return 0;
 }
 
@@ -1642,7 +1786,7 @@ int cf_file_read(CONF_SECTION *cs, char const *filename)
 
 	cf_item_add(cs, &(cp->item));
 
-	MEM(tree = rbtree_create(cs, _filename_cmp, NULL, 0));
+	MEM(tree = rbtree_create(cs, cf_file_cmp, NULL, 0));
 
 	cf_data_add(cs, tree, "filename", false);
 
@@ -31,6 +31,7 @@ RCSIDH(cf_priv_h, "$Id$")
 #include <freeradius-devel/cf_parse.h>
 #include <freeradius-devel/rbtree.h>
 #include <freeradius-devel/cursor.h>
+#include <freeradius-devel/sha1.h>
 
 typedef enum conf_type {
 	CONF_ITEM_INVALID = 0,
@@ -142,8 +143,28 @@ typedef struct cf_file_t {
 	char const		*filename;
 	CONF_SECTION		*cs;
 	struct stat		buf;
+	bool			digested;	//!< Whether digest is set.
+	uint8_t			digest[SHA1_DIGEST_LENGTH];	//!< Of the contents, when they're being cached.
 } cf_file_t;
 
+/** Things other than config files, which the parsed config depends on
+ *
+ */
+typedef enum {
+	CF_CACHE_DEP_DIRECTORY = 0,	//!< A directory that was included.
+	CF_CACHE_DEP_MISSING,		//!< An optional file which didn't exist.
+	CF_CACHE_DEP_ENV		//!< An environment variable.
+} cf_cache_dep_type_t;
+
+int		cf_file_cmp(void const *a, void const *b);
+
+/*
+ *	cf_cache.c
+ */
+bool		cf_cache_recording(void);
+void		cf_cache_digest(uint8_t digest[SHA1_DIGEST_LENGTH], uint8_t const *data, size_t len);
+void		cf_cache_dep_add(cf_cache_dep_type_t type, char const *name, char const *value);
+
 #ifdef __cplusplus
 }
 #endif
@@ -33,8 +33,18 @@ RCSID("$Id$")
 
 #include <sys/stat.h>
 
+#include <freeradius-devel/trie.h>
+#include <freeradius-devel/io/rate_limit.h>
+
 #include <ctype.h>
 #include <fcntl.h>
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
 
 #ifdef WITH_DYNAMIC_CLIENTS
 #ifdef HAVE_DIRENT_H
@@ -42,13 +52,37 @@ RCSID("$Id$")
 #endif
 #endif
 
+/** Clients with the same address and prefix, but different protocols
+ *
+ */
+typedef struct {
+	RADCLIENT	**clients;		//!< Talloced array.
+} client_prefix_t;
+
+/** Trie used to find clients by address
+ *
+ * Never changed once it's been compiled.  When clients are added or
+ * deleted, a new trie is compiled, and swapped in.  Old tries are kept
+ * for as long as deleted clients are, as lookups may still be using them.
+ */
+typedef struct client_trie_t client_trie_t;
+struct client_trie_t {
+	fr_trie_t	*trie;			//!< Of client_prefix_t.
+	time_t		retired;		//!< When it was replaced.
+	client_trie_t	*next;			//!< Older retired trie.
+};
+
 /** Group of clients
  *
  */
 struct radclient_list {
 	char const	*name;			//!< Name of the client list.
 	rbtree_t	*trees[129];		//!< For 0..128, inclusive.
-	uint32_t       	min_prefix;
+
+	atomic_uintptr_t	trie;		//!< client_trie_t used by client_find().
+	atomic_bool	dirty;			//!< Clients have changed since the trie was compiled.
+	pthread_mutex_t	mutex;			//!< Serialises compiling the trie.
+	client_trie_t	*retired;		//!< Newest first.
 };
 
 #ifdef WITH_STATS
@@ -147,6 +181,22 @@ static int client_num_cmp(void const *one, void const *two)
 }
 #endif
 
+static int _client_list_free(RADCLIENT_LIST *clients)
+{
+	client_trie_t *ct, *next;
+
+	talloc_free((client_trie_t *) atomic_load(&clients->trie));
+
+	for (ct = clients->retired; ct; ct = next) {
+		next = ct->next;
+		talloc_free(ct);
+	}
+
+	pthread_mutex_destroy(&clients->mutex);
+
+	return 0;
+}
+
 /** Return a new client list
  *
  * @note The container won't contain any clients.
@@ -162,11 +212,102 @@ RADCLIENT_LIST *client_list_init(CONF_SECTION *cs)
 	if (!clients) return NULL;
 
 	clients->name = talloc_strdup(clients, cs ? cf_section_name1(cs) : "root");
-	clients->min_prefix = 128;
+
+	atomic_init(&clients->trie, (uintptr_t) NULL);
+	atomic_init(&clients->dirty, false);
+	pthread_mutex_init(&clients->mutex, NULL);
+	talloc_set_destructor(clients, _client_list_free);
 
 	return clients;
 }
 
+/** Find the list a client should be added to
+ *
+ * @param clients list the caller wants to use, may be NULL if the global
+ *	client list, or the client's virtual server's list should be used.
+ * @param client to find the list for.
+ * @return
+ *	- The client list.
+ *	- NULL on error.
+ */
+static RADCLIENT_LIST *client_list_for(RADCLIENT_LIST *clients, RADCLIENT const *client)
+{
+	/*
+	 *	If "clients" is NULL, it means add to the global list,
+	 *	unless we're trying to add it to a virtual server...
+	 */
+	if (clients) return clients;
+
+	if (client->server != NULL) {
+		CONF_SECTION *cs;
+		CONF_SECTION *subcs;
+
+		cs = virtual_server_find(client->server);
+		if (!cs) {
+			ERROR("Failed to find virtual server %s", client->server);
+			return NULL;
+		}
+
+		/*
+		 *	If this server has no "listen" section, add the clients
+		 *	to the global client list.
+		 */
+		subcs = cf_section_find(cs, "listen", NULL);
+		if (!subcs) goto global_clients;
+
+		/*
+		 *	If the client list already exists, use that.
+		 *	Otherwise, create a new client list.
+		 */
+		clients = cf_data_value(cf_data_find(cs, RADCLIENT_LIST, NULL));
+		if (!clients) {
+			clients = client_list_init(cs);
+			if (!clients) {
+				ERROR("Out of memory");
+				return NULL;
+			}
+
+			if (!cf_data_add(cs, clients, NULL, true)) {
+				ERROR("Failed to associate clients with virtual server %s", client->server);
+				talloc_free(clients);
+				return NULL;
+			}
+		}
+
+	} else {
+	global_clients:
+		/*
+		 *	Initialize the global list, if not done already.
+		 */
+		if (!root_clients) {
+			root_clients = client_list_init(NULL);
+			if (!root_clients) return NULL;
+		}
+		clients = root_clients;
+	}
+
+	return clients;
+}
+
+/** Check whether two clients with the same address are defined identically
+ *
+ */
+static bool client_same(RADCLIENT const *old, RADCLIENT const *client)
+{
+#define namecmp(a) ((!old->a && !client->a) || (old->a && client->a && (strcmp(old->a, client->a) == 0)))
+	return ((fr_ipaddr_cmp(&old->ipaddr, &client->ipaddr) == 0) &&
+		(old->ipaddr.prefix == client->ipaddr.prefix) &&
+		namecmp(longname) && namecmp(secret) &&
+		namecmp(shortname) && namecmp(nas_type) &&
+		namecmp(login) && namecmp(password) && namecmp(server) &&
+#ifdef WITH_DYNAMIC_CLIENTS
+		(old->lifetime == client->lifetime) &&
+		namecmp(client_server) &&
+#endif
+		(old->message_authenticator == client->message_authenticator));
+#undef namecmp
+}
+
 /** Add a client to a RADCLIENT_LIST
  *
  * @param clients list to add client to, may be NULL if global client list is being used.
@@ -206,72 +347,20 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	fr_inet_ntop_prefix(buffer, sizeof(buffer), &client->ipaddr);
 	DEBUG3("Adding client %s (%s) to prefix tree %i", buffer, client->longname, client->ipaddr.prefix);
 
-	/*
-	 *	If "clients" is NULL, it means add to the global list,
-	 *	unless we're trying to add it to a virtual server...
-	 */
-	if (!clients) {
-		if (client->server != NULL) {
-			CONF_SECTION *cs;
-			CONF_SECTION *subcs;
-
-			cs = virtual_server_find(client->server);
-			if (!cs) {
-				ERROR("Failed to find virtual server %s", client->server);
-				return false;
-			}
-
-			/*
-			 *	If this server has no "listen" section, add the clients
-			 *	to the global client list.
-			 */
-			subcs = cf_section_find(cs, "listen", NULL);
-			if (!subcs) goto global_clients;
-
-			/*
-			 *	If the client list already exists, use that.
-			 *	Otherwise, create a new client list.
-			 */
-			clients = cf_data_value(cf_data_find(cs, RADCLIENT_LIST, NULL));
-			if (!clients) {
-				clients = client_list_init(cs);
-				if (!clients) {
-					ERROR("Out of memory");
-					return false;
-				}
-
-				if (!cf_data_add(cs, clients, NULL, true)) {
-					ERROR("Failed to associate clients with virtual server %s", client->server);
-					talloc_free(clients);
-					return false;
-				}
-			}
-
-		} else {
-		global_clients:
-			/*
-			 *	Initialize the global list, if not done already.
-			 */
-			if (!root_clients) {
-				root_clients = client_list_init(NULL);
-				if (!root_clients) return false;
-			}
-			clients = root_clients;
-		}
-	}
+	clients = client_list_for(clients, client);
+	if (!clients) return false;
 
 	/*
 	 *	Create a tree for it.
 	 */
 	if (!clients->trees[client->ipaddr.prefix]) {
-		clients->trees[client->ipaddr.prefix] = rbtree_create(clients, client_ipaddr_cmp, NULL, 0);
+		clients->trees[client->ipaddr.prefix] = rbtree_create(clients, client_ipaddr_cmp, NULL,
+								      RBTREE_FLAG_LOCK);
 		if (!clients->trees[client->ipaddr.prefix]) {
 			return false;
 		}
 	}
 
-#define namecmp(a) ((!old->a && !client->a) || (old->a && client->a && (strcmp(old->a, client->a) == 0)))
-
 	/*
 	 *	Cannot insert the same client twice.
 	 */
@@ -281,16 +370,7 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 		 *	If it's a complete duplicate, then free the new
 		 *	one, and return "OK".
 		 */
-		if ((fr_ipaddr_cmp(&old->ipaddr, &client->ipaddr) == 0) &&
-		    (old->ipaddr.prefix == client->ipaddr.prefix) &&
-		    namecmp(longname) && namecmp(secret) &&
-		    namecmp(shortname) && namecmp(nas_type) &&
-		    namecmp(login) && namecmp(password) && namecmp(server) &&
-#ifdef WITH_DYNAMIC_CLIENTS
-		    (old->lifetime == client->lifetime) &&
-		    namecmp(client_server) &&
-#endif
-		    (old->message_authenticator == client->message_authenticator)) {
+		if (client_same(old, client)) {
 			WARN("Ignoring duplicate client %s", client->longname);
 			client_free(client);
 			return true;
@@ -299,7 +379,18 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 		ERROR("Failed to add duplicate client %s", client->shortname);
 		return false;
 	}
-#undef namecmp
+
+	/*
+	 *	The HMAC-MD5 pads depend only on the secret, so hash
+	 *	them once here, instead of for every packet.
+	 */
+	if (client->secret && !client->hmac_key) {
+		client->hmac_key = talloc(client, fr_hmac_md5_key_t);
+		if (!client->hmac_key) return false;
+
+		fr_hmac_md5_key_init(client->hmac_key, (uint8_t const *) client->secret,
+				     talloc_array_length(client->secret) - 1);
+	}
 
 	/*
 	 *	Other error adding client: likely is fatal.
@@ -310,7 +401,7 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 
 #ifdef WITH_STATS
 	if (!tree_num) {
-		tree_num = rbtree_create(clients, client_num_cmp, NULL, 0);
+		tree_num = rbtree_create(clients, client_num_cmp, NULL, RBTREE_FLAG_LOCK);
 	}
 
 #ifdef WITH_DYNAMIC_CLIENTS
@@ -340,9 +431,7 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	if (tree_num) rbtree_insert(tree_num, client);
 #endif
 
-	if (client->ipaddr.prefix < clients->min_prefix) {
-		clients->min_prefix = client->ipaddr.prefix;
-	}
+	atomic_store(&clients->dirty, true);
 
 	(void) talloc_steal(clients, client); /* reparent it */
 
@@ -367,6 +456,48 @@ void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 	rbtree_deletebydata(tree_num, client);
 #endif
 	rbtree_deletebydata(clients->trees[client->ipaddr.prefix], client);
+	atomic_store(&clients->dirty, true);
+}
+
+/** Add a client to a RADCLIENT_LIST, replacing any dynamic client with the same address
+ *
+ * Used to pick up changes to clients read from a database.  Clients
+ * defined in the configuration files are never replaced.
+ *
+ * @param clients list to add client to, may be NULL if global client list is being used.
+ * @param client to add.
+ * @return
+ *	- true on success.
+ *	- false on failure.
+ */
+bool client_replace(RADCLIENT_LIST *clients, RADCLIENT *client)
+{
+	RADCLIENT *old;
+
+	if (!client) return false;
+
+	clients = client_list_for(clients, client);
+	if (!clients) return false;
+
+	/*
+	 *	Remove the old client if it's different, otherwise
+	 *	client_add() refuses to add the new one.
+	 */
+	old = clients->trees[client->ipaddr.prefix] ?
+	      rbtree_finddata(clients->trees[client->ipaddr.prefix], client) : NULL;
+	if (old && (old->dynamic == 1)) {
+		if (client_same(old, client)) {
+			client_free(client);
+			return true;
+		}
+
+		DEBUG2("Replacing client %s", old->longname);
+
+		client_delete(clients, old);
+		client_free(old);
+	}
+
+	return client_add(clients, client);
 }
 #endif
 
@@ -401,42 +532,154 @@ RADCLIENT *client_findbynumber(UNUSED const RADCLIENT_LIST *clients, UNUSED int
 #endif
 
 
+/*
+ *	Add a client to the trie which is being compiled.
+ */
+static int _client_trie_add(void *ctx, void *data)
+{
+	fr_trie_t	*trie = ctx;
+	RADCLIENT	*client = data;
+	client_prefix_t	*cp;
+	size_t		num;
+
+	cp = fr_trie_exact(trie, &client->ipaddr);
+	if (!cp) {
+		cp = talloc_zero(trie, client_prefix_t);
+		if (!cp) return -1;
+
+		if (fr_trie_insert(trie, &client->ipaddr, cp) < 0) return -1;
+	}
+
+	num = talloc_array_length(cp->clients);
+	cp->clients = talloc_realloc(cp, cp->clients, RADCLIENT *, num + 1);
+	if (!cp->clients) return -1;
+
+	cp->clients[num] = client;
+
+	return 0;
+}
+
+/** Compile a new trie for a client list, if the clients have changed
+ *
+ * @param clients to compile the trie for.
+ * @return
+ *	- The trie to use.  If compiling fails, the old trie is returned.
+ */
+static client_trie_t *client_trie_compile(RADCLIENT_LIST *clients)
+{
+	client_trie_t	*ct, *old, **last;
+	time_t		now;
+	int		i;
+
+	pthread_mutex_lock(&clients->mutex);
+
+	/*
+	 *	Another thread compiled it while we were waiting.
+	 */
+	if (!atomic_exchange(&clients->dirty, false)) {
+		pthread_mutex_unlock(&clients->mutex);
+		return (client_trie_t *) atomic_load(&clients->trie);
+	}
+
+	ct = talloc_zero(NULL, client_trie_t);
+	if (!ct) {
+	oom:
+		ERROR("Failed compiling client list %s: %s", clients->name, fr_strerror());
+		talloc_free(ct);
+		atomic_store(&clients->dirty, true);
+		pthread_mutex_unlock(&clients->mutex);
+		return (client_trie_t *) atomic_load(&clients->trie);
+	}
+
+	ct->trie = fr_trie_alloc(ct);
+	if (!ct->trie) goto oom;
+
+	for (i = 0; i <= 128; i++) {
+		if (!clients->trees[i]) continue;
+
+		if (rbtree_walk(clients->trees[i], RBTREE_IN_ORDER, _client_trie_add, ct->trie) != 0) goto oom;
+	}
+
+	if (fr_trie_compile(ct->trie) < 0) goto oom;
+
+	old = (client_trie_t *) atomic_exchange(&clients->trie, (uintptr_t) ct);
+
+	/*
+	 *	Free the tries which nothing can be using any more.
+	 *	They're kept for as long as deleted clients are.
+	 */
+	now = time(NULL);
+	if (old) {
+		old->retired = now;
+		old->next = clients->retired;
+		clients->retired = old;
+	}
+
+	for (last = &clients->retired; *last; last = &(*last)->next) {
+		if (((*last)->retired + 120) < now) break;
+	}
+
+	while (*last) {
+		old = *last;
+		*last = old->next;
+		talloc_free(old);
+	}
+
+	pthread_mutex_unlock(&clients->mutex);
+
+	return ct;
+}
+
 /*
  *	Find a client in the RADCLIENTS list.
  */
 RADCLIENT *client_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr, int proto)
 {
-	int32_t i, max_prefix;
-	RADCLIENT myclient;
+	client_trie_t		*ct;
+	client_prefix_t		*cp;
+	fr_trie_cursor_t	cursor;
 
 	if (!clients) clients = root_clients;
 
 	if (!clients || !ipaddr) return NULL;
 
-	switch (ipaddr->af) {
-	case AF_INET:
-		max_prefix = 32;
-		break;
-
-	case AF_INET6:
-		max_prefix = 128;
-		break;
+	/*
+	 *	The trie is compiled by the first lookup after the
+	 *	clients change, so that adding many clients doesn't
+	 *	compile it many times.
+	 */
+	if (atomic_load(&clients->dirty)) {
+		RADCLIENT_LIST *mutable;
 
-	default :
-		return NULL;
+		memcpy(&mutable, &clients, sizeof(mutable));
+		ct = client_trie_compile(mutable);
+	} else {
+		ct = (client_trie_t *) atomic_load(&clients->trie);
 	}
+	if (!ct) return NULL;
 
-	for (i = max_prefix; i >= (int32_t) clients->min_prefix; i--) {
-		void *data;
+	/*
+	 *	Longest prefix first.  If none of the clients with
+	 *	that prefix take this protocol, try the next shorter
+	 *	prefix.
+	 */
+	for (cp = fr_trie_find(ct->trie, &cursor, ipaddr);
+	     cp;
+	     cp = fr_trie_next(&cursor)) {
+		size_t i;
 
-		if (!clients->trees[i]) continue;
+		for (i = 0; i < talloc_array_length(cp->clients); i++) {
+			RADCLIENT *client = cp->clients[i];
 
-		myclient.ipaddr = *ipaddr;
-		myclient.proto = proto;
-		fr_ipaddr_mask(&myclient.ipaddr, i);
+			if ((ipaddr->af == AF_INET6) && (client->ipaddr.scope_id != ipaddr->scope_id)) continue;
+
+#ifdef WITH_TCP
+			if ((client->proto != IPPROTO_IP) && (proto != IPPROTO_IP) &&
+			    (client->proto != proto)) continue;
+#endif
 
-		data = rbtree_finddata(clients->trees[i], &myclient);
-		if (data) return data;
+			return client;
+		}
 	}
 
 	return NULL;
@@ -467,6 +710,21 @@ static CONF_PARSER limit_config[] = {
 };
 #endif
 
+/*
+ *	Checked by the network thread, before the packets are given to
+ *	a worker.
+ */
+static CONF_PARSER rate_config[] = {
+	{ FR_CONF_OFFSET("auth", FR_TYPE_UINT32, RADCLIENT, auth_rate), .dflt = "0" },
+	{ FR_CONF_OFFSET("auth_burst", FR_TYPE_UINT32, RADCLIENT, auth_burst), .dflt = "0" },
+
+	{ FR_CONF_OFFSET("accounting", FR_TYPE_UINT32, RADCLIENT, acct_rate), .dflt = "0" },
+	{ FR_CONF_OFFSET("accounting_burst", FR_TYPE_UINT32, RADCLIENT, acct_burst), .dflt = "0" },
+
+	{ FR_CONF_OFFSET("action", FR_TYPE_STRING, RADCLIENT, rate_action), .dflt = "drop" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER client_config[] = {
 	{ FR_CONF_POINTER("ipaddr", FR_TYPE_COMBO_IP_PREFIX, &cl_ipaddr) },
 	{ FR_CONF_POINTER("ipv4addr", FR_TYPE_IPV4_PREFIX, &cl_ipaddr) },
@@ -485,6 +743,7 @@ static const CONF_PARSER client_config[] = {
 	{ FR_CONF_OFFSET("password", FR_TYPE_STRING, RADCLIENT, password) },
 	{ FR_CONF_OFFSET("virtual_server", FR_TYPE_STRING, RADCLIENT, server) },
 	{ FR_CONF_OFFSET("response_window", FR_TYPE_TIMEVAL, RADCLIENT, response_window) },
+	{ FR_CONF_POINTER("rate", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) rate_config },
 
 #ifdef WITH_TCP
 	{ FR_CONF_POINTER("proto", FR_TYPE_STRING, &hs_proto) },
@@ -495,6 +754,8 @@ static const CONF_PARSER client_config[] = {
 	{ FR_CONF_OFFSET("dynamic_clients", FR_TYPE_STRING, RADCLIENT, client_server) },
 	{ FR_CONF_OFFSET("lifetime", FR_TYPE_UINT32, RADCLIENT, lifetime) },
 	{ FR_CONF_OFFSET("rate_limit", FR_TYPE_BOOL, RADCLIENT, rate_limit) },
+	{ FR_CONF_OFFSET("lookup_rate", FR_TYPE_UINT32, RADCLIENT, lookup_rate), .dflt = "0" },
+	{ FR_CONF_OFFSET("negative_lifetime", FR_TYPE_UINT32, RADCLIENT, negative_lifetime), .dflt = "10" },
 #endif
 	CONF_PARSER_TERMINATOR
 };
@@ -690,6 +951,235 @@ static const CONF_PARSER dynamic_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+#define CLIENT_ADMIT_MAX_NEGATIVE	65536
+
+/** Lookups of dynamic clients in a network
+ *
+ * Packets from addresses which have no client are dropped, without
+ * running the dynamic_clients virtual server, if a lookup for the
+ * address is already running, if a lookup for it failed in the last
+ * "negative_lifetime" seconds, or if the network has already had
+ * "lookup_rate" lookups this second.
+ */
+struct client_admit_t {
+	pthread_mutex_t		mutex;
+	fr_hash_table_t		*ht;		//!< client_admit_entry_t, by address.
+	fr_fifo_t		*negative;	//!< Entries for failed lookups, oldest first.
+
+	time_t			window;		//!< The second "lookups" counts for.
+	uint32_t		lookups;
+
+	client_admit_stats_t	stats;
+};
+
+typedef struct {
+	fr_ipaddr_t		ipaddr;
+	bool			in_flight;	//!< A lookup is running, otherwise it failed.
+	time_t			expires;	//!< When a failed lookup is forgotten.
+} client_admit_entry_t;
+
+static uint32_t client_admit_hash(void const *data)
+{
+	client_admit_entry_t const *entry = data;
+	uint32_t hash;
+
+	hash = fr_hash(&entry->ipaddr.af, sizeof(entry->ipaddr.af));
+	if (entry->ipaddr.af == AF_INET) {
+		return fr_hash_update(&entry->ipaddr.addr.v4, sizeof(entry->ipaddr.addr.v4), hash);
+	}
+
+	return fr_hash_update(&entry->ipaddr.addr.v6, sizeof(entry->ipaddr.addr.v6), hash);
+}
+
+static int client_admit_cmp(void const *one, void const *two)
+{
+	client_admit_entry_t const *a = one;
+	client_admit_entry_t const *b = two;
+
+	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+}
+
+static void client_admit_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+static int _client_admit_free(client_admit_t *admit)
+{
+	pthread_mutex_destroy(&admit->mutex);
+
+	return 0;
+}
+
+static client_admit_t *client_admit_alloc(RADCLIENT *network)
+{
+	client_admit_t *admit;
+
+	admit = talloc_zero(network, client_admit_t);
+	if (!admit) return NULL;
+
+	admit->ht = fr_hash_table_create(admit, client_admit_hash, client_admit_cmp, client_admit_entry_free);
+	if (!admit->ht) {
+		talloc_free(admit);
+		return NULL;
+	}
+
+	pthread_mutex_init(&admit->mutex, NULL);
+	talloc_set_destructor(admit, _client_admit_free);
+
+	return admit;
+}
+
+/** Check whether a dynamic client should be looked up
+ *
+ * If this returns true, client_admit_done() must be called when the
+ * lookup has finished.
+ *
+ * @param network the address is in.
+ * @param ipaddr of the unknown client.
+ * @param now the current time.
+ * @return
+ *	- true if the dynamic_clients virtual server should be run.
+ *	- false if the packet should be dropped.
+ */
+bool client_admit(RADCLIENT *network, fr_ipaddr_t const *ipaddr, time_t now)
+{
+	client_admit_t		*admit = network->admit;
+	client_admit_entry_t	my_entry, *entry;
+
+	if (!admit) return true;
+
+	pthread_mutex_lock(&admit->mutex);
+
+	/*
+	 *	Forget the failed lookups which have expired.  They
+	 *	all have the same lifetime, so they expire in order.
+	 */
+	if (admit->negative) {
+		while ((entry = fr_fifo_peek(admit->negative)) && (entry->expires <= now)) {
+			(void) fr_fifo_pop(admit->negative);
+			fr_hash_table_delete(admit->ht, entry);
+		}
+	}
+
+	memset(&my_entry, 0, sizeof(my_entry));
+	my_entry.ipaddr = *ipaddr;
+
+	entry = fr_hash_table_finddata(admit->ht, &my_entry);
+	if (entry) {
+		if (entry->in_flight) {
+			admit->stats.coalesced++;
+		} else {
+			admit->stats.negative++;
+		}
+		pthread_mutex_unlock(&admit->mutex);
+		return false;
+	}
+
+	if (network->lookup_rate) {
+		if (admit->window != now) {
+			admit->window = now;
+			admit->lookups = 0;
+		}
+
+		if (admit->lookups >= network->lookup_rate) {
+			admit->stats.rate_limited++;
+			pthread_mutex_unlock(&admit->mutex);
+			return false;
+		}
+		admit->lookups++;
+	}
+
+	admit->stats.lookups++;
+
+	/*
+	 *	If we're out of memory, do the lookup anyway.
+	 */
+	entry = talloc_zero(admit, client_admit_entry_t);
+	if (entry) {
+		entry->ipaddr = *ipaddr;
+		entry->in_flight = true;
+		if (!fr_hash_table_insert(admit->ht, entry)) talloc_free(entry);
+	}
+
+	pthread_mutex_unlock(&admit->mutex);
+
+	return true;
+}
+
+/** Record the result of looking up a dynamic client
+ *
+ * @param network the address is in.
+ * @param ipaddr of the client, as passed to client_admit().
+ * @param created whether the lookup created a client.
+ * @param now the current time.
+ */
+void client_admit_done(RADCLIENT *network, fr_ipaddr_t const *ipaddr, bool created, time_t now)
+{
+	client_admit_t		*admit = network->admit;
+	client_admit_entry_t	my_entry, *entry;
+
+	if (!admit) return;
+
+	pthread_mutex_lock(&admit->mutex);
+
+	if (created) {
+		admit->stats.created++;
+	} else {
+		admit->stats.failed++;
+	}
+
+	memset(&my_entry, 0, sizeof(my_entry));
+	my_entry.ipaddr = *ipaddr;
+
+	entry = fr_hash_table_finddata(admit->ht, &my_entry);
+	if (!entry) goto done;
+
+	if (created || !network->negative_lifetime) {
+		fr_hash_table_delete(admit->ht, entry);
+		goto done;
+	}
+
+	if (!admit->negative) {
+		admit->negative = fr_fifo_create(admit, CLIENT_ADMIT_MAX_NEGATIVE, NULL);
+		if (!admit->negative) {
+			fr_hash_table_delete(admit->ht, entry);
+			goto done;
+		}
+	}
+
+	/*
+	 *	Too many failed lookups.  Forget the oldest one.
+	 */
+	if (fr_fifo_num_elements(admit->negative) >= CLIENT_ADMIT_MAX_NEGATIVE) {
+		fr_hash_table_delete(admit->ht, fr_fifo_pop(admit->negative));
+	}
+
+	entry->in_flight = false;
+	entry->expires = now + network->negative_lifetime;
+	(void) fr_fifo_push(admit->negative, entry);
+
+done:
+	pthread_mutex_unlock(&admit->mutex);
+}
+
+/** Return the counters for the dynamic client lookups of a network
+ *
+ */
+void client_admit_stats(RADCLIENT *network, client_admit_stats_t *stats)
+{
+	client_admit_t *admit = network->admit;
+
+	if (!admit) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+
+	pthread_mutex_lock(&admit->mutex);
+	*stats = admit->stats;
+	pthread_mutex_unlock(&admit->mutex);
+}
+
 /** Add a dynamic client
  *
  */
@@ -1008,6 +1498,37 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, CONF_SECTION *serv
 		FR_TIMEVAL_BOUND_CHECK("response_window", &c->response_window, <=, main_config.max_request_time, 0);
 	}
 
+	/*
+	 *	A client which is a network shares its buckets with
+	 *	every address in the network.
+	 */
+	if (!c->rate_action || (strcmp(c->rate_action, "drop") == 0)) {
+		c->rate_defer = false;
+
+	} else if (strcmp(c->rate_action, "defer") == 0) {
+		c->rate_defer = true;
+
+	} else {
+		cf_log_err(cs, "Invalid value for rate.action '%s'.  Must be 'drop' or 'defer'", c->rate_action);
+		goto error;
+	}
+
+	if (c->auth_rate) {
+		c->auth_limit = fr_rate_limit_alloc(c, c->auth_rate, c->auth_burst);
+		if (!c->auth_limit) {
+			cf_log_err(cs, "Failed creating rate limit: %s", fr_strerror());
+			goto error;
+		}
+	}
+
+	if (c->acct_rate) {
+		c->acct_limit = fr_rate_limit_alloc(c, c->acct_rate, c->acct_burst);
+		if (!c->acct_limit) {
+			cf_log_err(cs, "Failed creating rate limit: %s", fr_strerror());
+			goto error;
+		}
+	}
+
 #ifdef WITH_DYNAMIC_CLIENTS
 	/*
 	 *	The virtual server we run UNKNOWN requests through, to
@@ -1028,6 +1549,17 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, CONF_SECTION *serv
 			goto error;
 		}
 
+		/*
+		 *	"rate_limit" used to mean one new client per second.
+		 */
+		if (c->rate_limit && !c->lookup_rate) c->lookup_rate = 1;
+
+		c->admit = client_admit_alloc(c);
+		if (!c->admit) {
+			cf_log_err(cs, "Out of memory");
+			goto error;
+		}
+
 		return c;
 	}
 #endif
@@ -27,6 +27,10 @@
 #include <freeradius-devel/md5.h>
 #include <freeradius-devel/conduit.h>
 #include <freeradius-devel/state.h>
+#include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/io/metrics.h>
+#include <freeradius-devel/io/memory.h>
+#include <freeradius-devel/io/ring_buffer.h>
 
 #include <libgen.h>
 #ifdef HAVE_INTTYPES_H
@@ -828,6 +832,7 @@ static int command_hup(rad_listen_t *listener, int argc, char *argv[])
 {
 	CONF_SECTION *cs;
 	module_instance_t *instance;
+	char buffer[256];
 
 	if (argc == 0) {
 		radius_signal_self(RADIUS_SIGNAL_SELF_HUP);
@@ -851,9 +856,23 @@ static int command_hup(rad_listen_t *listener, int argc, char *argv[])
 		return CMD_FAIL;
 	}
 
-	cprintf_error(listener, "HUP - NYI in version 4");
+	switch (module_hup_module(instance, NULL, process_global_event_list(EVENT_CORRAL_MAIN), time(NULL))) {
+	case 1:
+		break;
 
-	return CMD_FAIL;
+	case 0:
+		cprintf_error(listener, "Module \"%s\" can't be reloaded, or was reloaded recently\n", argv[0]);
+		return CMD_FAIL;
+
+	default:
+		cprintf_error(listener, "Failed to reload module\n");
+		return CMD_FAIL;
+	}
+
+	snprintf(buffer, sizeof(buffer), "modules.%s.hup", instance->module->name);
+	trigger_exec(NULL, instance->dl_inst->conf, buffer, true, NULL);
+
+	return CMD_OK;
 }
 
 static int command_terminate(UNUSED rad_listen_t *listener,
@@ -1082,6 +1101,7 @@ static int command_show_module_flags(rad_listen_t *listener, int argc, char *arg
 	}
 
 	if ((instance->module->type & RLM_TYPE_THREAD_UNSAFE) != 0) cprintf(listener, "thread-unsafe\n");
+	if ((instance->module->type & RLM_TYPE_SHADOW_SAFE) != 0) cprintf(listener, "shadow-safe\n");
 
 	return CMD_OK;
 }
@@ -1615,6 +1635,70 @@ static int command_profiler_cpu_show_status(rad_listen_t *listener, UNUSED int a
 }
 #endif
 
+/** Start the unlang profiler
+ *
+ */
+static int command_profiler_unlang_start(rad_listen_t *listener, int argc, char *argv[])
+{
+	unsigned long rate = 1;
+
+	if (argc > 0) {
+		char *end;
+
+		rate = strtoul(argv[0], &end, 10);
+		if (*end || (rate == 0) || (rate > UINT32_MAX)) {
+			cprintf_error(listener, "Invalid sample rate '%s'\n", argv[0]);
+			return CMD_FAIL;
+		}
+	}
+
+	unlang_profile_start(rate);
+
+	return CMD_OK;
+}
+
+/** Stop the unlang profiler
+ *
+ */
+static int command_profiler_unlang_stop(UNUSED rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	unlang_profile_stop();
+
+	return CMD_OK;
+}
+
+/** Show what the unlang profiler has collected, as collapsed stacks
+ *
+ */
+static int command_show_profiler_unlang(rad_listen_t *listener, int argc, char *argv[])
+{
+	unlang_profile_metric_t metric = UNLANG_PROFILE_TIME;
+	char *out;
+
+	if (argc > 0) {
+		if (strcmp(argv[0], "calls") == 0) {
+			metric = UNLANG_PROFILE_CALLS;
+		} else if (strcmp(argv[0], "yields") == 0) {
+			metric = UNLANG_PROFILE_YIELDS;
+		} else if (strcmp(argv[0], "time") != 0) {
+			cprintf_error(listener, "Unknown counter '%s', expected 'calls', 'time' or 'yields'\n",
+				      argv[0]);
+			return CMD_FAIL;
+		}
+	}
+
+	out = unlang_profile_collapsed(NULL, metric);
+	if (!out) {
+		cprintf_error(listener, "Failed printing profile\n");
+		return CMD_FAIL;
+	}
+
+	cprintf(listener, "%s", out);
+	talloc_free(out);
+
+	return CMD_OK;
+}
+
 static int command_show_debug_condition(rad_listen_t *listener,
 					UNUSED int argc, UNUSED char *argv[])
 {
@@ -1744,6 +1828,591 @@ static int command_show_listener_enabled(rad_listen_t *listener, UNUSED int argc
 	return CMD_OK;
 }
 
+static int command_show_thread_workers(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	fr_schedule_worker_stats_t stats;
+
+	if (!main_config.scheduler) {
+		cprintf_error(listener, "The server is not using network and worker threads\n");
+		return CMD_FAIL;
+	}
+
+	fr_schedule_worker_stats(main_config.scheduler, &stats);
+
+	cprintf(listener, "workers\t\t%d\n", stats.num_workers);
+	if (stats.target) {
+		cprintf(listener, "target\t\t%d\n", stats.target);
+	} else {
+		cprintf(listener, "target\t\tauto\n");
+	}
+	cprintf(listener, "min_workers\t%d\n", stats.min_workers);
+	cprintf(listener, "max_workers\t%d\n", stats.max_workers);
+	cprintf(listener, "load\t\t%d%%\n", stats.load);
+
+	return CMD_OK;
+}
+
+static int command_show_log_stats(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	fr_log_async_stats_t stats;
+
+	fr_log_async_stats(&stats);
+
+	if (!stats.running) {
+		cprintf(listener, "async		no\n");
+		return CMD_OK;
+	}
+
+	cprintf(listener, "async		yes\n");
+	cprintf(listener, "ring_size	%zu\n", stats.ring_size);
+	cprintf(listener, "rings		%u\n", stats.rings);
+	cprintf(listener, "queued_bytes	%" PRIu64 "\n", stats.queued);
+	cprintf(listener, "written		%" PRIu64 "\n", stats.written);
+	cprintf(listener, "dropped		%" PRIu64 "\n", stats.dropped);
+	cprintf(listener, "blocked		%" PRIu64 "\n", stats.blocked);
+
+	return CMD_OK;
+}
+
+static int command_show_thread_stats(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	int i, j;
+	fr_schedule_thread_stats_t *stats;
+
+	if (!main_config.scheduler) {
+		cprintf_error(listener, "The server is not using network and worker threads\n");
+		return CMD_FAIL;
+	}
+
+	stats = fr_schedule_thread_stats(NULL, main_config.scheduler);
+	if (!stats) {
+		cprintf_error(listener, "%s\n", fr_strerror());
+		return CMD_FAIL;
+	}
+
+	for (i = 0; i < stats->num_networks; i++) {
+		fr_network_stats_t *ns = &stats->network[i];
+		uint64_t dropped = 0;
+
+		for (j = 0; j < FR_NETWORK_DROP_MAX; j++) dropped += ns->dropped[j];
+
+		cprintf(listener, "network %d\n", stats->network_id[i]);
+		cprintf(listener, "\trequests\t%" PRIu64 "\n", ns->num_requests);
+		cprintf(listener, "\treplies\t\t%" PRIu64 "\n", ns->num_replies);
+		cprintf(listener, "\tdropped\t\t%" PRIu64 "\n", dropped);
+		cprintf(listener, "\tsockets\t\t%d\n", ns->num_sockets);
+		cprintf(listener, "\tworkers\t\t%d\n", ns->num_workers);
+		cprintf(listener, "\tclosing\t\t%d\n", ns->num_closing);
+		cprintf(listener, "\tpending\t\t%d\n", ns->num_pending);
+	}
+
+	for (i = 0; i < stats->num_workers; i++) {
+		fr_worker_stats_t *ws = &stats->worker[i];
+
+		cprintf(listener, "worker %d%s\n", stats->worker_id[i], ws->retiring ? " (retiring)" : "");
+		cprintf(listener, "\tchannels\t%d\n", ws->num_channels);
+		cprintf(listener, "\trequests\t%d\n", ws->num_requests);
+		cprintf(listener, "\tdecoded\t\t%d\n", ws->num_decoded);
+		cprintf(listener, "\treplies\t\t%d\n", ws->num_replies);
+		cprintf(listener, "\ttimeouts\t%d\n", ws->num_timeouts);
+		cprintf(listener, "\texpired\t\t%d\n", ws->num_expired);
+		cprintf(listener, "\tstolen\t\t%d\n", ws->num_stolen);
+		cprintf(listener, "\tpool_overflows\t%d\n", ws->num_pool_overflows);
+		cprintf(listener, "\tto_decode\t%d\n", ws->to_decode);
+		cprintf(listener, "\tlocalized\t%d\n", ws->localized);
+		cprintf(listener, "\trunnable\t%d\n", ws->runnable);
+		cprintf(listener, "\trunning_usec\t%" PRIu64 "\n", (uint64_t) (ws->running / 1000));
+		cprintf(listener, "\twaiting_usec\t%" PRIu64 "\n", (uint64_t) (ws->waiting / 1000));
+		cprintf(listener, "\tpredicted_usec\t%" PRIu64 "\n", (uint64_t) (ws->predicted / 1000));
+	}
+
+	if (stats->num_missing) {
+		cprintf(listener, "%d threads did not reply\n", stats->num_missing);
+	}
+
+	talloc_free(stats);
+
+	return CMD_OK;
+}
+
+/** Totals for one module or client, for "show top"
+ *
+ */
+typedef struct {
+	char		*labels;		//!< which identify the module or client.
+	uint64_t	value[2];		//!< totals, e.g. run and yield time.
+	uint64_t	delta[2];		//!< how much each value went up since the last "show top".
+	uint64_t	busy;			//!< sum of the deltas, to sort by.
+} command_top_t;
+
+typedef struct {
+	TALLOC_CTX	*ctx;			//!< to allocate the entries in.
+	command_top_t	*top;			//!< entries, in the order they were found.
+	int		num;			//!< entries filled in.
+	int		which;			//!< value which is being filled in.
+} command_top_list_t;
+
+/*
+ *	The totals from the last "show top", so it can show what the
+ *	server has been doing since then.  Only the main thread runs
+ *	commands, so these don't need locking.
+ */
+static command_top_list_t	top_modules;
+static command_top_list_t	top_clients;
+static fr_time_t		top_when;
+
+static int _command_top_add(void *uctx, char const *labels, uint64_t value)
+{
+	command_top_list_t *list = uctx;
+	command_top_t *top;
+
+	if (list->num == (int) talloc_array_length(list->top)) {
+		top = talloc_realloc(list->ctx, list->top, command_top_t, (list->num * 2) + 16);
+		if (!top) return -1;
+		list->top = top;
+	}
+
+	top = &list->top[list->num];
+	memset(top, 0, sizeof(*top));
+	top->labels = talloc_strdup(list->ctx, labels);
+	if (!top->labels) return -1;
+	top->value[list->which] = value;
+	list->num++;
+
+	return 0;
+}
+
+static int command_top_cmp(void const *one, void const *two)
+{
+	command_top_t const *a = one;
+	command_top_t const *b = two;
+
+	return strcmp(a->labels, b->labels);
+}
+
+static int command_top_delta_cmp(void const *one, void const *two)
+{
+	command_top_t const *a = *(command_top_t const * const *) one;
+	command_top_t const *b = *(command_top_t const * const *) two;
+
+	return (a->busy < b->busy) - (a->busy > b->busy);
+}
+
+/** Add up the counters for each module or client, and work out what changed since last time
+ *
+ * @param[out] list	to fill in.  It's sorted by labels.
+ * @param[in] old	totals from the last time, or an empty list.
+ * @param[in] name	of the metrics to add up.  NULL terminated.
+ * @return
+ *	- <0 on error.
+ *	- 0 on success.
+ */
+static int command_top_gather(command_top_list_t *list, command_top_list_t const *old, char const **name)
+{
+	int i, j;
+
+	for (list->which = 0; name[list->which]; list->which++) {
+		if (fr_metric_walk(name[list->which], _command_top_add, list) < 0) return -1;
+	}
+	if (!list->num) return 0;
+
+	/*
+	 *	There is one set for each module in each thread, and
+	 *	clients have a counter for each type of packet.
+	 */
+	qsort(list->top, list->num, sizeof(list->top[0]), command_top_cmp);
+	for (i = 0, j = 1; j < list->num; j++) {
+		if (strcmp(list->top[i].labels, list->top[j].labels) == 0) {
+			list->top[i].value[0] += list->top[j].value[0];
+			list->top[i].value[1] += list->top[j].value[1];
+			continue;
+		}
+		list->top[++i] = list->top[j];
+	}
+	list->num = i + 1;
+
+	for (i = 0; i < list->num; i++) {
+		command_top_t *top = &list->top[i];
+		command_top_t *prev = NULL;
+
+		if (old->num) prev = bsearch(top, old->top, old->num, sizeof(old->top[0]), command_top_cmp);
+
+		for (j = 0; j < 2; j++) {
+			uint64_t before = prev ? prev->value[j] : 0;
+
+			/*
+			 *	Gauges, or counters of modules which
+			 *	were reloaded, may go backwards.
+			 */
+			if (top->value[j] > before) top->delta[j] = top->value[j] - before;
+			top->busy += top->delta[j];
+		}
+	}
+
+	return 0;
+}
+
+/** Return the entries with the largest deltas, largest first
+ *
+ */
+static command_top_t **command_top_sort(TALLOC_CTX *ctx, command_top_list_t const *list)
+{
+	command_top_t **sorted;
+	int i;
+
+	sorted = talloc_array(ctx, command_top_t *, list->num);
+	if (!sorted) return NULL;
+
+	for (i = 0; i < list->num; i++) sorted[i] = &list->top[i];
+	qsort(sorted, list->num, sizeof(sorted[0]), command_top_delta_cmp);
+
+	return sorted;
+}
+
+/** Print the value of a single label, or all of the labels
+ *
+ *  e.g. 'module="sql"' is printed as 'sql'.
+ */
+static char const *command_top_name(char *buffer, size_t bufsize, char const *labels)
+{
+	char const *p, *q;
+
+	p = strchr(labels, '"');
+	if (!p) return labels;
+	q = strchr(p + 1, '"');
+	if (!q || (q[1] != '\0') || ((size_t) (q - p) > bufsize)) return labels;
+
+	strlcpy(buffer, p + 1, q - p);
+	return buffer;
+}
+
+typedef struct {
+	int				id;		//!< of the worker.
+	fr_worker_stats_request_t	*request;
+} command_top_request_t;
+
+static int command_top_request_cmp(void const *one, void const *two)
+{
+	command_top_request_t const *a = one;
+	command_top_request_t const *b = two;
+
+	return (a->request->elapsed < b->request->elapsed) - (a->request->elapsed > b->request->elapsed);
+}
+
+static char const *top_module_metrics[] = {
+	"freeradius_module_run_nanoseconds", "freeradius_module_yielded_nanoseconds", NULL
+};
+
+static char const *top_client_metrics[] = {
+	"freeradius_client_requests", NULL
+};
+
+/** Show what the server is busy with
+ *
+ *  The oldest requests are the ones which are running now.  The
+ *  modules and clients are what changed since the last "show top".
+ */
+static int command_show_top(rad_listen_t *listener, int argc, char *argv[])
+{
+	TALLOC_CTX			*ctx;
+	unsigned long			count = 10;
+	fr_schedule_thread_stats_t	*stats;
+	command_top_request_t		*requests;
+	command_top_list_t		modules, clients;
+	command_top_t			**sorted;
+	fr_time_t			now;
+	char				buffer[256];
+	int				i, j, num = 0;
+
+	if (argc > 0) {
+		char *end;
+
+		count = strtoul(argv[0], &end, 10);
+		if (*end || (count == 0) || (count > 1000)) {
+			cprintf_error(listener, "Invalid count '%s'\n", argv[0]);
+			return CMD_FAIL;
+		}
+	}
+
+	if (!main_config.scheduler) {
+		cprintf_error(listener, "The server is not using network and worker threads\n");
+		return CMD_FAIL;
+	}
+
+	ctx = talloc_new(NULL);
+	if (!ctx) {
+	oom:
+		cprintf_error(listener, "Out of memory\n");
+		return CMD_FAIL;
+	}
+
+	stats = fr_schedule_thread_stats(ctx, main_config.scheduler);
+	if (!stats) {
+		cprintf_error(listener, "%s\n", fr_strerror());
+		talloc_free(ctx);
+		return CMD_FAIL;
+	}
+
+	/*
+	 *	The oldest requests, from all of the workers.
+	 */
+	requests = talloc_array(ctx, command_top_request_t, (stats->num_workers * FR_WORKER_STATS_OLDEST) + 1);
+	if (!requests) {
+		talloc_free(ctx);
+		goto oom;
+	}
+
+	for (i = 0; i < stats->num_workers; i++) {
+		for (j = 0; j < stats->worker[i].num_oldest; j++) {
+			requests[num].id = stats->worker_id[i];
+			requests[num].request = &stats->worker[i].oldest[j];
+			num++;
+		}
+	}
+	qsort(requests, num, sizeof(requests[0]), command_top_request_cmp);
+
+	cprintf(listener, "requests\n");
+	for (i = 0; (i < num) && (i < (int) count); i++) {
+		fr_worker_stats_request_t *r = requests[i].request;
+
+		cprintf(listener, "\t%" PRIu64 "\tworker %d\t%" PRIu64 " ms\t%s\t%s\n", r->number, requests[i].id,
+			(uint64_t) (r->elapsed / 1000000), r->component[0] ? r->component : "-",
+			r->module[0] ? r->module : "-");
+	}
+
+	/*
+	 *	The modules and clients which did the most since last
+	 *	time.
+	 */
+	memset(&modules, 0, sizeof(modules));
+	memset(&clients, 0, sizeof(clients));
+	modules.ctx = talloc_new(NULL);
+	clients.ctx = talloc_new(NULL);
+	if (!modules.ctx || !clients.ctx ||
+	    (command_top_gather(&modules, &top_modules, top_module_metrics) < 0) ||
+	    (command_top_gather(&clients, &top_clients, top_client_metrics) < 0)) {
+		talloc_free(modules.ctx);
+		talloc_free(clients.ctx);
+		talloc_free(ctx);
+		goto oom;
+	}
+
+	now = fr_time();
+	if (top_when) {
+		cprintf(listener, "interval\t%" PRIu64 " ms\n", (uint64_t) ((now - top_when) / 1000000));
+	} else {
+		cprintf(listener, "interval\tsince the server started\n");
+	}
+
+	sorted = command_top_sort(ctx, &modules);
+	cprintf(listener, "modules\n");
+	for (i = 0; sorted && (i < modules.num) && (i < (int) count); i++) {
+		if (!sorted[i]->busy) break;
+
+		cprintf(listener, "\t%s\trun %" PRIu64 " ms\tyielded %" PRIu64 " ms\n",
+			command_top_name(buffer, sizeof(buffer), sorted[i]->labels),
+			sorted[i]->delta[0] / 1000000, sorted[i]->delta[1] / 1000000);
+	}
+
+	sorted = command_top_sort(ctx, &clients);
+	cprintf(listener, "clients\n");
+	for (i = 0; sorted && (i < clients.num) && (i < (int) count); i++) {
+		if (!sorted[i]->busy) break;
+
+		cprintf(listener, "\t%s\t%" PRIu64 " requests\n",
+			command_top_name(buffer, sizeof(buffer), sorted[i]->labels), sorted[i]->busy);
+	}
+
+	if (stats->num_missing) {
+		cprintf(listener, "%d threads did not reply\n", stats->num_missing);
+	}
+
+	/*
+	 *	Remember the totals for next time.
+	 */
+	talloc_free(top_modules.ctx);
+	talloc_free(top_clients.ctx);
+	top_modules = modules;
+	top_clients = clients;
+	top_when = now;
+
+	talloc_free(ctx);
+
+	return CMD_OK;
+}
+
+/** Print the value of one label
+ *
+ *  e.g. "name" of 'type="module",name="sql"' is printed as 'sql'.
+ */
+static char const *command_memory_label(char *buffer, size_t bufsize, char const *labels, char const *label)
+{
+	char const	*p, *q;
+	size_t		len = strlen(label);
+
+	for (p = labels; p; p = strchr(p, ',')) {
+		if (*p == ',') p++;
+		if ((strncmp(p, label, len) == 0) && (p[len] == '=') && (p[len + 1] == '"')) break;
+	}
+	if (!p) return "-";
+
+	p += len + 2;
+	q = strchr(p, '"');
+	if (!q || ((size_t) (q - p) >= bufsize)) return "-";
+
+	strlcpy(buffer, p, (q - p) + 1);
+	return buffer;
+}
+
+/*
+ *	The totals from the last "show memory", for the allocation rate.
+ */
+static command_top_list_t	memory_last;
+static fr_time_t		memory_when;
+
+static char const *memory_used_metrics[] = {
+	"freeradius_memory_bytes", "freeradius_memory_allocated_bytes", NULL
+};
+
+static char const *memory_peak_metrics[] = {
+	"freeradius_memory_peak_bytes", NULL
+};
+
+static char const *memory_limit_metrics[] = {
+	"freeradius_memory_soft_limit_bytes", "freeradius_memory_hard_limit_bytes", NULL
+};
+
+/** Show the memory used by modules, session-state, pools and message sets
+ *
+ *  Largest first.  The rate is of increases in the memory in use,
+ *  since the last "show memory".
+ */
+static int command_show_memory(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	TALLOC_CTX		*ctx;
+	command_top_list_t	used, peak, limits, empty;
+	command_top_t		**sorted;
+	fr_time_t		now;
+	char			type[64], name[256];
+	int			i;
+
+	ctx = talloc_new(NULL);
+	if (!ctx) {
+	oom:
+		cprintf_error(listener, "Out of memory\n");
+		return CMD_FAIL;
+	}
+
+	/*
+	 *	The threads measure their message sets when they're
+	 *	asked for their stats.
+	 */
+	if (main_config.scheduler) (void) fr_schedule_thread_stats(ctx, main_config.scheduler);
+
+	memset(&used, 0, sizeof(used));
+	memset(&peak, 0, sizeof(peak));
+	memset(&limits, 0, sizeof(limits));
+	memset(&empty, 0, sizeof(empty));
+	used.ctx = talloc_new(NULL);
+	peak.ctx = limits.ctx = ctx;
+	if (!used.ctx ||
+	    (command_top_gather(&used, &memory_last, memory_used_metrics) < 0) ||
+	    (command_top_gather(&peak, &empty, memory_peak_metrics) < 0) ||
+	    (command_top_gather(&limits, &empty, memory_limit_metrics) < 0)) {
+		talloc_free(used.ctx);
+		talloc_free(ctx);
+		goto oom;
+	}
+
+	now = fr_time();
+	if (memory_when) {
+		cprintf(listener, "interval\t%" PRIu64 " ms\n", (uint64_t) ((now - memory_when) / 1000000));
+	} else {
+		cprintf(listener, "interval\tsince the server started\n");
+	}
+
+	/*
+	 *	Largest first.
+	 */
+	for (i = 0; i < used.num; i++) used.top[i].busy = used.top[i].value[0];
+	sorted = command_top_sort(ctx, &used);
+
+	cprintf(listener, "type\tname\tbytes\tpeak\trate/s\tsoft_limit\thard_limit\n");
+	for (i = 0; sorted && (i < used.num); i++) {
+		command_top_t	*top = sorted[i];
+		command_top_t	*p = NULL, *l = NULL;
+		char		rate[32];
+
+		if (peak.num) p = bsearch(top, peak.top, peak.num, sizeof(peak.top[0]), command_top_cmp);
+		if (limits.num) l = bsearch(top, limits.top, limits.num, sizeof(limits.top[0]), command_top_cmp);
+
+		if (memory_when && (now > memory_when)) {
+			snprintf(rate, sizeof(rate), "%" PRIu64,
+				 (uint64_t) (top->delta[1] / ((double) (now - memory_when) / 1000000000)));
+		} else {
+			strlcpy(rate, "-", sizeof(rate));
+		}
+
+		cprintf(listener, "%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%s\t%" PRIu64 "\t%" PRIu64 "\n",
+			command_memory_label(type, sizeof(type), top->labels, "type"),
+			command_memory_label(name, sizeof(name), top->labels, "name"),
+			top->value[0], p ? p->value[0] : 0, rate,
+			l ? l->value[0] : 0, l ? l->value[1] : 0);
+	}
+
+	/*
+	 *	Remember the totals for next time.
+	 */
+	talloc_free(memory_last.ctx);
+	memory_last = used;
+	memory_when = now;
+
+	talloc_free(ctx);
+
+	return CMD_OK;
+}
+
+static int command_show_thread_hugepages(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	fr_ring_buffer_pages_stats_t stats;
+
+	static char const *pages[] = { "no", "transparent", "yes" };
+
+	fr_ring_buffer_pages_stats(&stats);
+
+	cprintf(listener, "hugepages\t%s\n", pages[stats.pages]);
+	cprintf(listener, "huge\t\t%zu\n", stats.huge);
+	cprintf(listener, "transparent\t%zu\n", stats.transparent);
+	cprintf(listener, "fallback\t%zu\n", stats.fallback);
+
+	return CMD_OK;
+}
+
+#ifdef WITH_TLS
+static int command_show_tls_engines(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	tls_engine_stats_t	*stats;
+	size_t			i, num;
+
+	num = tls_engine_stats(NULL, &stats);
+	if (!num) {
+		cprintf(listener, "No engines loaded\n");
+		talloc_free(stats);
+		return CMD_OK;
+	}
+
+	for (i = 0; i < num; i++) {
+		cprintf(listener, "%s\n", stats[i].id);
+		cprintf(listener, "\tsuccess\t\t%" PRIu64 "\n", stats[i].success);
+		cprintf(listener, "\tfallback\t%" PRIu64 "\n", stats[i].fallback);
+	}
+
+	talloc_free(stats);
+
+	return CMD_OK;
+}
+#endif
+
 /*
  *	For encode/decode stuff
  */
@@ -2090,14 +2759,36 @@ static fr_command_table_t command_table_profiler_cpu[] = {
 	{ NULL, 0, NULL, NULL, NULL }
 };
 
+#endif
+
+/** Commands to control the unlang profiler
+ *
+ */
+static fr_command_table_t command_table_profiler_unlang[] = {
+	{ "start", FR_WRITE,
+	  "profiler unlang start [<rate>] - Start timing unlang instructions, one in every <rate> (default 1)",
+	  command_profiler_unlang_start, NULL },
+
+	{ "stop", FR_WRITE,
+	  "profiler unlang stop - Stop timing unlang instructions, keeping the data collected so far",
+	  command_profiler_unlang_stop, NULL },
+
+	{ NULL, 0, NULL, NULL, NULL }
+};
+
 static fr_command_table_t command_table_profiler[] = {
+#ifdef HAVE_GPERFTOOLS_PROFILER_H
 	{ "cpu", FR_WRITE,
 	  "profiler cpu <command> do sub-command of cpu profiler",
 	  NULL, command_table_profiler_cpu },
+#endif
+
+	{ "unlang", FR_WRITE,
+	  "profiler unlang <command> do sub-command of unlang profiler",
+	  NULL, command_table_profiler_unlang },
 
 	{ NULL, 0, NULL, NULL, NULL }
 };
-#endif
 
 static fr_command_table_t command_table_show_debug_level[] = {
 	{ "global", FR_WRITE,
@@ -2172,6 +2863,40 @@ static fr_command_table_t command_table_show_listeners[] = {
 	{ NULL, 0, NULL, NULL, NULL }
 };
 
+static fr_command_table_t command_table_show_log[] = {
+	{ "stats", FR_READ,
+	  "show log stats - show how many log messages the log writer thread has written, or dropped",
+	  command_show_log_stats, NULL },
+
+	{ NULL, 0, NULL, NULL, NULL }
+};
+
+static fr_command_table_t command_table_show_thread[] = {
+	{ "stats", FR_READ,
+	  "show thread stats - show the counters and queue depths of each network and worker thread",
+	  command_show_thread_stats, NULL },
+
+	{ "hugepages", FR_READ,
+	  "show thread hugepages - show how many bytes of the thread buffers are on huge pages",
+	  command_show_thread_hugepages, NULL },
+
+	{ "workers", FR_READ,
+	  "show thread workers - show the number of worker threads, and how busy they are",
+	  command_show_thread_workers, NULL },
+
+	{ NULL, 0, NULL, NULL, NULL }
+};
+
+#ifdef WITH_TLS
+static fr_command_table_t command_table_show_tls[] = {
+	{ "engines", FR_READ,
+	  "show tls engines - show how many private key operations each engine performed, or fell back to software",
+	  command_show_tls_engines, NULL },
+
+	{ NULL, 0, NULL, NULL, NULL }
+};
+#endif
+
 #ifdef HAVE_GPERFTOOLS_PROFILER_H
 static fr_command_table_t command_table_show_profiler_cpu[] = {
 	{ "file", FR_WRITE,
@@ -2193,14 +2918,21 @@ static fr_command_table_t command_table_show_profiler_cpu[] = {
 	{ NULL, 0, NULL, NULL, NULL }
 };
 
+#endif
+
 static fr_command_table_t command_table_show_profiler[] = {
+#ifdef HAVE_GPERFTOOLS_PROFILER_H
 	{ "cpu", FR_WRITE,
 	  "show profiler cpu <command> do sub-command of cpu profiler",
 	  NULL, command_table_show_profiler_cpu },
+#endif
+
+	{ "unlang", FR_READ,
+	  "show profiler unlang [calls|time|yields] - show the unlang profile as collapsed stacks, for flamegraph.pl",
+	  command_show_profiler_unlang, NULL },
 
 	{ NULL, 0, NULL, NULL, NULL }
 };
-#endif
 
 static fr_command_table_t command_table_show[] = {
 	{ "client", FR_READ,
@@ -2215,6 +2947,13 @@ static fr_command_table_t command_table_show[] = {
 	{ "listener", FR_READ,
 	  "show listener <command> - do sub-command of listener",
 	  NULL, command_table_show_listeners },
+	{ "log", FR_READ,
+	  "show log <command> - do sub-command of log",
+	  NULL, command_table_show_log },
+
+	{ "memory", FR_READ,
+	  "show memory - show the memory used by modules, session-state, pools and message sets",
+	  command_show_memory, NULL },
 
 #ifndef NDEBUG
 	{ "memory-report", FR_READ,
@@ -2226,12 +2965,24 @@ static fr_command_table_t command_table_show[] = {
 	  "show module <command> - do sub-command of module",
 	  NULL, command_table_show_module },
 
-#ifdef HAVE_GPERFTOOLS_PROFILER_H
 	{ "profiler", FR_READ,
 	  "show profiler <command> - do sub-command of profiler",
 	  NULL, command_table_show_profiler },
+
+	{ "thread", FR_READ,
+	  "show thread <command> - do sub-command of thread",
+	  NULL, command_table_show_thread },
+
+#ifdef WITH_TLS
+	{ "tls", FR_READ,
+	  "show tls <command> - do sub-command of tls",
+	  NULL, command_table_show_tls },
 #endif
 
+	{ "top", FR_READ,
+	  "show top [<count>] - show the oldest requests, and the busiest modules and clients since the last \"show top\"",
+	  command_show_top, NULL },
+
 	{ "uptime", FR_READ,
 	  "show uptime - shows time at which server started",
 	  command_uptime, NULL },
@@ -2384,6 +3135,39 @@ static int command_set_listener_enabled(rad_listen_t *listener, int argc, char *
 	return CMD_OK;
 }
 
+static int command_set_thread_workers(rad_listen_t *listener, int argc, char *argv[])
+{
+	int num;
+	char *end;
+
+	if (argc < 1) {
+		cprintf_error(listener, "No value was provided\n");
+		return CMD_FAIL;
+	}
+
+	if (!main_config.scheduler) {
+		cprintf_error(listener, "The server is not using network and worker threads\n");
+		return CMD_FAIL;
+	}
+
+	if (strcmp(argv[0], "auto") == 0) {
+		num = 0;
+	} else {
+		num = strtol(argv[0], &end, 10);
+		if (*end || (num <= 0)) {
+			cprintf_error(listener, "Invalid number of workers '%s'\n", argv[0]);
+			return CMD_FAIL;
+		}
+	}
+
+	if (fr_schedule_workers_set(main_config.scheduler, num) < 0) {
+		cprintf_error(listener, "%s\n", fr_strerror());
+		return CMD_FAIL;
+	}
+
+	return CMD_OK;
+}
+
 #ifdef WITH_STATS
 static char const *elapsed_names[8] = {
 	"1us", "10us", "100us", "1ms", "10ms", "100ms", "1s", "10s"
@@ -2550,8 +3334,10 @@ static int command_stats_detail(rad_listen_t *listener, int argc, char *argv[])
 static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 {
 	bool auth = true;
-	fr_stats_t *stats;
-	RADCLIENT *client, fake;
+	fr_stats_t stats;
+	radius_stats_type_t type;
+	uint32_t *id;
+	RADCLIENT *client;
 
 	if (argc < 1) {
 		cprintf_error(listener, "Must specify [auth/acct]\n");
@@ -2562,15 +3348,7 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 		/*
 		 *	Global statistics.
 		 */
-		fake.auth = radius_auth_stats;
-#ifdef WITH_ACCOUNTING
-		fake.acct = radius_acct_stats;
-#endif
-#ifdef WITH_COA
-		fake.coa = radius_coa_stats;
-		fake.dsc = radius_dsc_stats;
-#endif
-		client = &fake;
+		id = &radius_stats_server;
 
 	} else {
 		/*
@@ -2578,16 +3356,17 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 		 */
 		client = get_client(listener, argc - 1, argv + 1);
 		if (!client) return 0;
+		id = &client->stats_id;
 	}
 
 	if (strcmp(argv[0], "auth") == 0) {
 		auth = true;
-		stats = &client->auth;
+		type = RADIUS_STATS_AUTH;
 
 	} else if (strcmp(argv[0], "acct") == 0) {
 #ifdef WITH_ACCOUNTING
 		auth = false;
-		stats = &client->acct;
+		type = RADIUS_STATS_ACCT;
 #else
 		cprintf_error(listener, "This server was built without accounting support.\n");
 		return 0;
@@ -2596,7 +3375,7 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 	} else if (strcmp(argv[0], "coa") == 0) {
 #ifdef WITH_COA
 		auth = false;
-		stats = &client->coa;
+		type = RADIUS_STATS_COA;
 #else
 		cprintf_error(listener, "This server was built without CoA support.\n");
 		return 0;
@@ -2605,7 +3384,7 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 	} else if (strcmp(argv[0], "disconnect") == 0) {
 #ifdef WITH_COA
 		auth = false;
-		stats = &client->dsc;
+		type = RADIUS_STATS_DSC;
 #else
 		cprintf_error(listener, "This server was built without CoA support.\n");
 		return 0;
@@ -2617,33 +3396,59 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 	}
 
 	/*
-	 *	Global results for all client.
+	 *	The counters are kept per thread, add them up.
 	 */
-	if (argc == 1) {
-#ifdef WITH_ACCOUNTING
-		if (!auth) {
-			return command_print_stats(listener,
-						   &radius_acct_stats, auth, 0);
-		}
-#endif
-		return command_print_stats(listener, &radius_auth_stats, auth, 0);
-	}
+	radius_stats_read(&stats, id, type);
 
-	return command_print_stats(listener, stats, auth, 0);
+	return command_print_stats(listener, &stats, auth, 0);
 }
 
+#ifdef WITH_DYNAMIC_CLIENTS
+static int command_stats_dynamic_clients(rad_listen_t *listener, int argc, char *argv[])
+{
+	RADCLIENT		*client;
+	client_admit_stats_t	stats;
+
+	if (argc < 1) {
+		cprintf_error(listener, "Must specify <ipaddr>\n");
+		return 0;
+	}
+
+	client = get_client(listener, argc, argv);
+	if (!client) return 0;
+
+	if (!client->client_server) {
+		cprintf_error(listener, "Client %s is not a dynamic client network\n", client->shortname);
+		return 0;
+	}
+
+	client_admit_stats(client, &stats);
+
+	cprintf(listener, "lookups		%" PRIu64 "\n", stats.lookups);
+	cprintf(listener, "created		%" PRIu64 "\n", stats.created);
+	cprintf(listener, "failed		%" PRIu64 "\n", stats.failed);
+	cprintf(listener, "coalesced	%" PRIu64 "\n", stats.coalesced);
+	cprintf(listener, "negative	%" PRIu64 "\n", stats.negative);
+	cprintf(listener, "rate_limited	%" PRIu64 "\n", stats.rate_limited);
+
+	return CMD_OK;
+}
+#endif
 
 static int command_stats_socket(rad_listen_t *listener, int argc, char *argv[])
 {
 	bool auth = true;
 	rad_listen_t *sock;
+	fr_stats_t stats;
 
 	sock = get_socket(listener, argc, argv, NULL);
 	if (!sock) return 0;
 
 	if (sock->type != RAD_LISTEN_AUTH) auth = false;
 
-	return command_print_stats(listener, &sock->stats, auth, 0);
+	radius_stats_read(&stats, &sock->stats_id, auth ? RADIUS_STATS_AUTH : RADIUS_STATS_ACCT);
+
+	return command_print_stats(listener, &stats, auth, 0);
 }
 #endif	/* WITH_STATS */
 
@@ -2767,6 +3572,14 @@ static fr_command_table_t command_table_set_listeners[] = {
 	{ NULL, 0, NULL, NULL, NULL }
 };
 
+static fr_command_table_t command_table_set_thread[] = {
+	{ "workers", FR_WRITE,
+	  "set thread workers <num|auto> - set the number of worker threads, or let the server decide",
+	  command_set_thread_workers, NULL },
+
+	{ NULL, 0, NULL, NULL, NULL }
+};
+
 static fr_command_table_t command_table_set[] = {
 	{ "module", FR_WRITE,
 	  "set module <command> - set module commands",
@@ -2774,6 +3587,9 @@ static fr_command_table_t command_table_set[] = {
 	{ "listener", FR_WRITE,
 	  "set listener <command> - set listener commands",
 	  NULL, command_table_set_listeners },
+	{ "thread", FR_WRITE,
+	  "set thread <command> - set thread commands",
+	  NULL, command_table_set_thread },
 
 	{ NULL, 0, NULL, NULL, NULL }
 };
@@ -2786,6 +3602,13 @@ static fr_command_table_t command_table_stats[] = {
 	  "- show statistics for given client, or for all clients (auth or acct)",
 	  command_stats_client, NULL },
 
+#ifdef WITH_DYNAMIC_CLIENTS
+	{ "dynamic-clients", FR_READ,
+	  "stats dynamic-clients <ipaddr> [udp|tcp] [listen <ipaddr> <port>] "
+	  "- show statistics for dynamic client lookups in the given network",
+	  command_stats_dynamic_clients, NULL },
+#endif
+
 #ifdef WITH_DETAIL
 	{ "detail", FR_READ,
 	  "stats detail <filename> - show statistics for the given detail file",
@@ -2828,11 +3651,9 @@ static fr_command_table_t command_table[] = {
 	  "inject <command> - commands to inject packets into a running server",
 	  NULL, command_table_inject },
 
-#ifdef HAVE_GPERFTOOLS_PROFILER_H
 	{ "profiler", FR_WRITE,
-	  "profiler <command> - commands to alter the state of the gperftools profiler",
+	  "profiler <command> - commands to alter the state of the gperftools or unlang profilers",
 	  NULL, command_table_profiler },
-#endif
 	{ "reconnect", FR_READ,
 	  "reconnect - reconnect to a running server",
 	  NULL, NULL },		/* just here for "help" */
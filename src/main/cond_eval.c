@@ -764,9 +764,9 @@ int cond_eval(REQUEST *request, int modreturn, int depth, fr_cond_t const *c)
  *	The fr_pair_list_move() function in src/lib/valuepair.c does all sorts of
  *	extra magic that we don't want here.
  *
- *	FIXME: integrate this with the code calling it, so that we
- *	only fr_pair_list_copy() those attributes that we're really going to
- *	use.
+ *	The pairs in the "to" list are edited in place.  They are
+ *	unchained into an array, and relinked once the operators have
+ *	been applied, so nothing in "to" is copied.
  */
 void radius_pairmove(REQUEST *request, VALUE_PAIR **to, VALUE_PAIR *from, bool do_xlat)
 {
@@ -775,10 +775,8 @@ void radius_pairmove(REQUEST *request, VALUE_PAIR **to, VALUE_PAIR *from, bool d
 	VALUE_PAIR *vp, *next, **last;
 	VALUE_PAIR **from_list, **to_list;
 	VALUE_PAIR *append, **append_tail;
-	VALUE_PAIR *to_copy;
 	bool *edited = NULL;
 	REQUEST *fixup = NULL;
-	TALLOC_CTX *ctx;
 
 	/*
 	 *	Set up arrays for editing, to remove some of the
@@ -822,14 +820,20 @@ void radius_pairmove(REQUEST *request, VALUE_PAIR **to, VALUE_PAIR *from, bool d
 		vp->next = NULL;
 	}
 
+	/*
+	 *	Expand everything before the "to" list is broken up,
+	 *	so that any references to it see the original
+	 *	attributes, and not a list which is half edited.
+	 */
+	if (do_xlat) for (i = 0; i < from_count; i++) xlat_eval_do(request, from_list[i]);
+
 	to_count = 0;
-	ctx = talloc_parent(*to);
-	to_copy = fr_pair_list_copy(ctx, *to);
-	for (vp = to_copy; vp != NULL; vp = next) {
+	for (vp = *to; vp != NULL; vp = next) {
 		next = vp->next;
 		to_list[to_count++] = vp;
 		vp->next = NULL;
 	}
+	*to = NULL;
 	tailto = to_count;
 	edited = talloc_zero_array(request, bool, to_count);
 
@@ -844,8 +848,6 @@ void radius_pairmove(REQUEST *request, VALUE_PAIR **to, VALUE_PAIR *from, bool d
 
 		RDEBUG4("::: Examining %s", from_list[i]->da->name);
 
-		if (do_xlat) xlat_eval_do(request, from_list[i]);
-
 		/*
 		 *	Attribute should be appended, OR the "to" list
 		 *	is empty, and we're supposed to replace or
@@ -1019,7 +1021,6 @@ void radius_pairmove(REQUEST *request, VALUE_PAIR **to, VALUE_PAIR *from, bool d
 	/*
 	 *	Re-chain the "to" list.
 	 */
-	fr_pair_list_free(to);
 	last = to;
 
 	if (to == &request->packet->vps) {
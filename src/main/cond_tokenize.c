@@ -104,14 +104,14 @@ next:
 		break;
 
 	case COND_TYPE_TRUE:
-		len = strlcpy(out, "true", outlen);
+		len = strlcpy(p, "true", end - p);
 		RETURN_IF_TRUNCATED(p, len, end - p);
-		return p - out;
+		break;
 
 	case COND_TYPE_FALSE:
-		len = strlcpy(out, "false", outlen);
+		len = strlcpy(p, "false", end - p);
 		RETURN_IF_TRUNCATED(p, len, end - p);
-		return p - out;
+		break;
 
 	default:
 		*out = '\0';
@@ -1693,6 +1693,25 @@ done:
 		c->next_op = COND_NONE;
 	}
 
+	/*
+	 *	FOO && true  --> FOO
+	 *	FOO || false --> FOO
+	 *
+	 *	The rest of the chain has already been normalized,
+	 *	so a trailing constant is a single node.  FOO is
+	 *	still evaluated, so xlat and exec side effects are
+	 *	unchanged.
+	 *
+	 *	We don't do FOO && false --> false, as FOO may fail
+	 *	at run time, and that failure has to be returned.
+	 */
+	if (c->next && !c->next->next && !c->next->negate &&
+	    (((c->next_op == COND_AND) && (c->next->type == COND_TYPE_TRUE)) ||
+	     ((c->next_op == COND_OR) && (c->next->type == COND_TYPE_FALSE)))) {
+		TALLOC_FREE(c->next);
+		c->next_op = COND_NONE;
+	}
+
 	if (lhs) talloc_free(lhs);
 	if (rhs) talloc_free(rhs);
 
@@ -373,7 +373,7 @@ static int _connection_free(fr_connection_t *conn)
  *	- NULL on failure.
  */
 fr_connection_t *fr_connection_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
-				     struct timeval *connection_timeout, struct timeval *reconnection_delay,
+				     struct timeval const *connection_timeout, struct timeval const *reconnection_delay,
 				     fr_connection_init_t init, fr_connection_open_t open, fr_connection_close_t close,
 				     char const *log_prefix,
 				     void *uctx)
@@ -0,0 +1,533 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ *
+ * @file detail.c
+ * @brief Binary detail records.
+ *
+ * Each record starts with a fixed header, in network byte order:
+ *
+ @verbatim
+   0  magic		4 bytes, 0xfd 'D' 'T' 'B'
+   4  length		4 bytes, of the whole record
+   8  crc		4 bytes, CRC-32 of everything after this field
+  12  version		1 byte
+  13  code		1 byte, of the packet
+  14  reserved		2 bytes
+  16  timestamp		4 bytes, seconds
+  20  timestamp		4 bytes, microseconds
+  24  src af, dst af	1 byte each
+  26  reserved		2 bytes
+  28  src ipaddr	16 bytes
+  44  dst ipaddr	16 bytes
+  60  src port		2 bytes
+  62  dst port		2 bytes
+ @endverbatim
+ *
+ * It's followed by the attributes, each of which is:
+ *
+ @verbatim
+   0  vendor		4 bytes
+   4  attr		4 bytes
+   8  type		1 byte, the data type of the attribute
+   9  tag		1 byte
+  10  length		2 bytes, of the value
+  12  value		as written by fr_value_box_to_network()
+ @endverbatim
+ *
+ * Attributes which can't be written that way (unknown attributes,
+ * and types with no network format) have type #FR_DETAIL_BINARY_TEXT,
+ * and the value is the attribute as text, "name = value".
+ *
+ * The magic number lets readers find the next record if one is
+ * damaged.
+ *
+ * @copyright 2026  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/detail.h>
+#include <freeradius-devel/rad_assert.h>
+
+#define DETAIL_BINARY_ATTR_HDR_LEN	(12)
+
+uint8_t const fr_detail_binary_magic[4] = { 0xfd, 'D', 'T', 'B' };
+
+/*
+ *	CRC-32 (IEEE 802.3), as used by zlib.
+ */
+static uint32_t const crc32_table[256] = {
+	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba,
+	0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
+	0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
+	0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de,
+	0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec,
+	0x14015c4f, 0x63066cd9, 0xfa0f3d63, 0x8d080df5,
+	0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
+	0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940,
+	0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116,
+	0x21b4f4b5, 0x56b3c423, 0xcfba9599, 0xb8bda50f,
+	0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,
+	0x76dc4190, 0x01db7106, 0x98d220bc, 0xefd5102a,
+	0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818,
+	0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
+	0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457,
+	0x65b0d9c6, 0x12b7e950, 0x8bbeb8ea, 0xfcb9887c,
+	0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2,
+	0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb,
+	0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9,
+	0x5005713c, 0x270241aa, 0xbe0b1010, 0xc90c2086,
+	0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4,
+	0x59b33d17, 0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad,
+	0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683,
+	0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8,
+	0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe,
+	0xf762575d, 0x806567cb, 0x196c3671, 0x6e6b06e7,
+	0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
+	0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252,
+	0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60,
+	0xdf60efc3, 0xa867df55, 0x316e8eef, 0x4669be79,
+	0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f,
+	0xc5ba3bbe, 0xb2bd0b28, 0x2bb45a92, 0x5cb36a04,
+	0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a,
+	0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
+	0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21,
+	0x86d3d2d4, 0xf1d4e242, 0x68ddb3f8, 0x1fda836e,
+	0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c,
+	0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45,
+	0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db,
+	0xaed16a4a, 0xd9d65adc, 0x40df0b66, 0x37d83bf0,
+	0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6,
+	0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf,
+	0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
+
+/** Calculate the CRC-32 of some data
+ *
+ * @param[in] data	to check.
+ * @param[in] data_len	of the data.
+ * @return the CRC.
+ */
+uint32_t fr_detail_crc32(uint8_t const *data, size_t data_len)
+{
+	uint32_t	crc = 0xffffffff;
+	size_t		i;
+
+	for (i = 0; i < data_len; i++) crc = crc32_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+	return crc ^ 0xffffffff;
+}
+
+static void detail_ipaddr_put(uint8_t *af, uint8_t *out, fr_ipaddr_t const *ipaddr)
+{
+	switch (ipaddr->af) {
+	case AF_INET:
+		*af = 4;
+		memcpy(out, &ipaddr->addr.v4.s_addr, 4);
+		break;
+
+	case AF_INET6:
+		*af = 6;
+		memcpy(out, &ipaddr->addr.v6, 16);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void detail_ipaddr_get(fr_ipaddr_t *ipaddr, uint8_t af, uint8_t const *in)
+{
+	memset(ipaddr, 0, sizeof(*ipaddr));
+
+	switch (af) {
+	case 4:
+		ipaddr->af = AF_INET;
+		ipaddr->prefix = 32;
+		memcpy(&ipaddr->addr.v4.s_addr, in, 4);
+		break;
+
+	case 6:
+		ipaddr->af = AF_INET6;
+		ipaddr->prefix = 128;
+		memcpy(&ipaddr->addr.v6, in, 16);
+		break;
+
+	default:
+		ipaddr->af = AF_UNSPEC;
+		break;
+	}
+}
+
+/** Whether an attribute can be written with its network format
+ *
+ */
+static bool detail_binary_encodable(VALUE_PAIR const *vp)
+{
+	if ((vp->type != VT_DATA) || vp->da->flags.is_unknown || vp->da->flags.is_raw) return false;
+
+	if (fr_dict_attr_by_num(NULL, vp->da->vendor, vp->da->attr) != vp->da) return false;
+
+	switch (vp->vp_type) {
+	case FR_TYPE_TIMEVAL:
+	case FR_TYPE_SIZE:
+	case FR_TYPE_ABINARY:
+	case FR_TYPE_STRUCTURAL:
+		return false;
+
+	default:
+		return true;
+	}
+}
+
+/** Write a binary detail record
+ *
+ * @param[in] ctx	to allocate the record in.
+ * @param[out] out	the record.
+ * @param[in] rec	the header fields.
+ * @param[in] vps	to write.
+ * @param[in] filter	if not NULL, called for each attribute.  Attributes
+ *			for which it returns true aren't written.
+ * @param[in] uctx	passed to the filter.
+ * @return
+ *	- The length of the record.
+ *	- -1 on failure.
+ */
+ssize_t fr_detail_binary_encode(TALLOC_CTX *ctx, uint8_t **out, fr_detail_record_t const *rec,
+				VALUE_PAIR *vps, fr_detail_filter_t filter, void *uctx)
+{
+	VALUE_PAIR	*vp;
+	size_t		len = FR_DETAIL_BINARY_HDR_LEN;
+	uint8_t		*record, *p;
+	char		buffer[1024];
+
+	/*
+	 *	Figure out how much room we need.
+	 */
+	for (vp = vps; vp; vp = vp->next) {
+		size_t value_len;
+
+		if (filter && filter(vp, uctx)) continue;
+
+		if (detail_binary_encodable(vp)) {
+			value_len = fr_value_box_network_length(&vp->data);
+		} else {
+			value_len = fr_pair_snprint(buffer, sizeof(buffer), vp);
+			if (value_len >= sizeof(buffer)) value_len = sizeof(buffer) - 1;
+		}
+		if (value_len > UINT16_MAX) value_len = UINT16_MAX;
+
+		len += DETAIL_BINARY_ATTR_HDR_LEN + value_len;
+	}
+
+	if (len > UINT32_MAX) {
+		fr_strerror_printf("Record is too large");
+		return -1;
+	}
+
+	record = p = talloc_zero_array(ctx, uint8_t, len);
+	if (!record) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	memcpy(p, fr_detail_binary_magic, sizeof(fr_detail_binary_magic));
+	p[12] = FR_DETAIL_BINARY_VERSION;
+	p[13] = rec->code;
+	p[16] = (rec->timestamp.tv_sec >> 24) & 0xff;
+	p[17] = (rec->timestamp.tv_sec >> 16) & 0xff;
+	p[18] = (rec->timestamp.tv_sec >> 8) & 0xff;
+	p[19] = rec->timestamp.tv_sec & 0xff;
+	p[20] = (rec->timestamp.tv_usec >> 24) & 0xff;
+	p[21] = (rec->timestamp.tv_usec >> 16) & 0xff;
+	p[22] = (rec->timestamp.tv_usec >> 8) & 0xff;
+	p[23] = rec->timestamp.tv_usec & 0xff;
+	detail_ipaddr_put(&p[24], &p[28], &rec->src_ipaddr);
+	detail_ipaddr_put(&p[25], &p[44], &rec->dst_ipaddr);
+	p[60] = rec->src_port >> 8;
+	p[61] = rec->src_port & 0xff;
+	p[62] = rec->dst_port >> 8;
+	p[63] = rec->dst_port & 0xff;
+
+	p += FR_DETAIL_BINARY_HDR_LEN;
+
+	for (vp = vps; vp; vp = vp->next) {
+		ssize_t	slen;
+		size_t	value_len;
+
+		if (filter && filter(vp, uctx)) continue;
+
+		p[0] = (vp->da->vendor >> 24) & 0xff;
+		p[1] = (vp->da->vendor >> 16) & 0xff;
+		p[2] = (vp->da->vendor >> 8) & 0xff;
+		p[3] = vp->da->vendor & 0xff;
+		p[4] = (vp->da->attr >> 24) & 0xff;
+		p[5] = (vp->da->attr >> 16) & 0xff;
+		p[6] = (vp->da->attr >> 8) & 0xff;
+		p[7] = vp->da->attr & 0xff;
+		p[9] = (uint8_t) vp->tag;
+
+		if (detail_binary_encodable(vp)) {
+			p[8] = vp->vp_type;
+			value_len = fr_value_box_network_length(&vp->data);
+			if (value_len > UINT16_MAX) value_len = UINT16_MAX;
+
+			slen = fr_value_box_to_network(NULL, p + DETAIL_BINARY_ATTR_HDR_LEN, value_len, &vp->data);
+			if (slen < 0) {
+			error:
+				talloc_free(record);
+				return -1;
+			}
+		} else {
+			p[8] = FR_DETAIL_BINARY_TEXT;
+			value_len = fr_pair_snprint(buffer, sizeof(buffer), vp);
+			if (value_len >= sizeof(buffer)) value_len = sizeof(buffer) - 1;
+
+			memcpy(p + DETAIL_BINARY_ATTR_HDR_LEN, buffer, value_len);
+			slen = value_len;
+		}
+		if ((size_t) slen != value_len) {
+			fr_strerror_printf("Failed encoding %s", vp->da->name);
+			goto error;
+		}
+
+		p[10] = value_len >> 8;
+		p[11] = value_len & 0xff;
+
+		p += DETAIL_BINARY_ATTR_HDR_LEN + value_len;
+	}
+
+	rad_assert((size_t)(p - record) == len);
+
+	record[4] = (len >> 24) & 0xff;
+	record[5] = (len >> 16) & 0xff;
+	record[6] = (len >> 8) & 0xff;
+	record[7] = len & 0xff;
+
+	{
+		uint32_t crc = fr_detail_crc32(record + 12, len - 12);
+
+		record[8] = (crc >> 24) & 0xff;
+		record[9] = (crc >> 16) & 0xff;
+		record[10] = (crc >> 8) & 0xff;
+		record[11] = crc & 0xff;
+	}
+
+	*out = record;
+
+	return len;
+}
+
+/** Check a binary detail record
+ *
+ * @param[in] data	the start of the record.
+ * @param[in] data_len	of the data available.
+ * @return
+ *	- The length of the record, if it's complete and undamaged.
+ *	- 0 if there isn't enough data for the whole record.
+ *	- -1 if the record is damaged.
+ */
+ssize_t fr_detail_binary_check(uint8_t const *data, size_t data_len)
+{
+	size_t		len;
+	uint32_t	crc;
+
+	if (data_len < 12) {
+		if (memcmp(data, fr_detail_binary_magic, data_len < 4 ? data_len : 4) != 0) goto bad_magic;
+		return 0;
+	}
+
+	if (memcmp(data, fr_detail_binary_magic, sizeof(fr_detail_binary_magic)) != 0) {
+	bad_magic:
+		fr_strerror_printf("Invalid magic number");
+		return -1;
+	}
+
+	len = (data[4] << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+	if (len < FR_DETAIL_BINARY_HDR_LEN) {
+		fr_strerror_printf("Invalid record length %zu", len);
+		return -1;
+	}
+
+	if (len > data_len) return 0;
+
+	crc = (data[8] << 24) | (data[9] << 16) | (data[10] << 8) | data[11];
+	if (fr_detail_crc32(data + 12, len - 12) != crc) {
+		fr_strerror_printf("CRC mismatch");
+		return -1;
+	}
+
+	if (data[12] != FR_DETAIL_BINARY_VERSION) {
+		fr_strerror_printf("Unsupported record version %u", data[12]);
+		return -1;
+	}
+
+	return len;
+}
+
+/** Find the next binary detail record
+ *
+ * Used to skip damaged records.
+ *
+ * @param[in] data	to search, after the start of the damaged record.
+ * @param[in] data_len	of the data.
+ * @return how many bytes to skip.  data_len if there's no record.
+ */
+size_t fr_detail_binary_resync(uint8_t const *data, size_t data_len)
+{
+	uint8_t const *p, *end = data + data_len;
+
+	for (p = data; p < end; p++) {
+		p = memchr(p, fr_detail_binary_magic[0], end - p);
+		if (!p) break;
+
+		if (((size_t)(end - p) < sizeof(fr_detail_binary_magic)) ||
+		    (memcmp(p, fr_detail_binary_magic, sizeof(fr_detail_binary_magic)) == 0)) return p - data;
+	}
+
+	return data_len;
+}
+
+/** Read a binary detail record
+ *
+ * The record must have been checked with #fr_detail_binary_check.
+ * Attributes which aren't in the dictionary, or whose type has changed,
+ * are skipped.
+ *
+ * @param[in] ctx	to allocate the attributes in.
+ * @param[out] rec	the header fields.
+ * @param[out] vps	the attributes are added here.
+ * @param[in] data	the record.
+ * @param[in] data_len	the length of the record.
+ * @return
+ *	- The number of attributes which were skipped.
+ *	- -1 on failure.
+ */
+int fr_detail_binary_decode(TALLOC_CTX *ctx, fr_detail_record_t *rec, VALUE_PAIR **vps,
+			    uint8_t const *data, size_t data_len)
+{
+	uint8_t const	*p, *end;
+	vp_cursor_t	cursor;
+	int		skipped = 0;
+	char		buffer[1024];
+
+	if (data_len < FR_DETAIL_BINARY_HDR_LEN) {
+		fr_strerror_printf("Record is too short");
+		return -1;
+	}
+
+	memset(rec, 0, sizeof(*rec));
+	rec->code = data[13];
+	rec->timestamp.tv_sec = (data[16] << 24) | (data[17] << 16) | (data[18] << 8) | data[19];
+	rec->timestamp.tv_usec = (data[20] << 24) | (data[21] << 16) | (data[22] << 8) | data[23];
+	detail_ipaddr_get(&rec->src_ipaddr, data[24], &data[28]);
+	detail_ipaddr_get(&rec->dst_ipaddr, data[25], &data[44]);
+	rec->src_port = (data[60] << 8) | data[61];
+	rec->dst_port = (data[62] << 8) | data[63];
+
+	fr_pair_cursor_init(&cursor, vps);
+	fr_pair_cursor_last(&cursor);
+
+	p = data + FR_DETAIL_BINARY_HDR_LEN;
+	end = data + data_len;
+
+	while (p < end) {
+		unsigned int		vendor, attr;
+		size_t			value_len;
+		fr_dict_attr_t const	*da;
+		VALUE_PAIR		*vp;
+
+		if ((end - p) < DETAIL_BINARY_ATTR_HDR_LEN) {
+		truncated:
+			fr_strerror_printf("Attribute overflows the record");
+			return -1;
+		}
+
+		vendor = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+		attr = (p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+		value_len = (p[10] << 8) | p[11];
+
+		if ((size_t)(end - p) < (DETAIL_BINARY_ATTR_HDR_LEN + value_len)) goto truncated;
+
+		if (p[8] == FR_DETAIL_BINARY_TEXT) {
+			if (value_len >= sizeof(buffer)) {
+				skipped++;
+				goto next;
+			}
+			memcpy(buffer, p + DETAIL_BINARY_ATTR_HDR_LEN, value_len);
+			buffer[value_len] = '\0';
+
+			vp = NULL;
+			if ((fr_pair_list_afrom_str(ctx, buffer, &vp) <= 0) || !vp) {
+				skipped++;
+				goto next;
+			}
+			fr_pair_cursor_merge(&cursor, vp);
+			goto next;
+		}
+
+		da = fr_dict_attr_by_num(NULL, vendor, attr);
+		if (!da || (da->type != p[8])) {
+			skipped++;
+			goto next;
+		}
+
+		vp = fr_pair_afrom_da(ctx, da);
+		if (!vp) {
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+		vp->tag = (int8_t) p[9];
+
+		if (fr_value_box_from_network(vp, &vp->data, da->type, da,
+					      p + DETAIL_BINARY_ATTR_HDR_LEN, value_len, true) != (ssize_t) value_len) {
+			talloc_free(vp);
+			skipped++;
+			goto next;
+		}
+		vp->type = VT_DATA;
+		fr_pair_cursor_append(&cursor, vp);
+
+	next:
+		p += DETAIL_BINARY_ATTR_HDR_LEN + value_len;
+	}
+
+	return skipped;
+}
@@ -29,13 +29,18 @@ RCSID("$Id$")
 #include <freeradius-devel/rad_assert.h>
 
 #include <sys/file.h>
+#include <sys/socket.h>
 
 #include <fcntl.h>
 #include <ctype.h>
+#include <signal.h>
 
 #ifdef HAVE_SYS_WAIT_H
 #	include <sys/wait.h>
 #endif
+#ifdef HAVE_SPAWN_H
+#	include <spawn.h>
+#endif
 #ifndef WEXITSTATUS
 #	define WEXITSTATUS(stat_val) ((unsigned)(stat_val) >> 8)
 #endif
@@ -53,6 +58,304 @@ static pid_t waitpid_wrapper(pid_t pid, int *status)
 pid_t (*rad_fork)(void) = fork;
 pid_t (*rad_waitpid)(pid_t pid, int *status) = waitpid_wrapper;
 
+#ifndef __MINGW32__
+/*
+ *	Programs we don't wait for are started by a launcher process.
+ *	It's forked before the modules are loaded, so it's small, and
+ *	starting a program doesn't mean forking the whole server.
+ */
+#define LAUNCHER_MAX_MSG (65536)
+
+static int		launcher_fd = -1;	//!< Socket to the launcher.
+static pid_t		launcher_pid = -1;
+static pthread_mutex_t	launcher_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Read exactly len bytes
+ *
+ * @return
+ *	- 1 on success.
+ *	- 0 on EOF.
+ *	- -1 on error.
+ */
+static int launcher_read(int fd, void *buff, size_t len)
+{
+	uint8_t *p = buff, *end = p + len;
+
+	while (p < end) {
+		ssize_t slen;
+
+		slen = read(fd, p, end - p);
+		if (slen == 0) return 0;
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += slen;
+	}
+
+	return 1;
+}
+
+/** Start a program from the launcher
+ *
+ * The program gets the same file descriptors as one started by
+ * #radius_start_program, when it doesn't wait.
+ */
+static void launcher_spawn(char **argv, char **envp, bool debug)
+{
+	pid_t				pid;
+#ifdef HAVE_SPAWN_H
+	posix_spawn_file_actions_t	actions;
+	posix_spawnattr_t		attr;
+	sigset_t			sigs;
+	int				ret;
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDWR, 0);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_RDWR, 0);
+	if (!debug) posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_RDWR, 0);
+
+	/*
+	 *	The launcher ignores SIGCHLD, so that its children
+	 *	are reaped automatically.  Programs shouldn't inherit
+	 *	that.
+	 */
+	posix_spawnattr_init(&attr);
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigaddset(&sigs, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigs);
+	sigemptyset(&sigs);
+	posix_spawnattr_setsigmask(&attr, &sigs);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+	ret = posix_spawn(&pid, argv[0], &actions, &attr, argv, envp);
+	if (ret != 0) ERROR("Failed to execute \"%s\": %s", argv[0], fr_syserror(ret));
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+#else
+	pid = fork();
+	if (pid == 0) {
+		int devnull;
+
+		signal(SIGCHLD, SIG_DFL);
+		signal(SIGPIPE, SIG_DFL);
+
+		devnull = open("/dev/null", O_RDWR);
+		if (devnull < 0) _exit(2);
+
+		dup2(devnull, STDIN_FILENO);
+		dup2(devnull, STDOUT_FILENO);
+		if (!debug) dup2(devnull, STDERR_FILENO);
+		close(devnull);
+
+		execve(argv[0], argv, envp);
+		_exit(2);
+	}
+	if (pid < 0) ERROR("Couldn't fork %s: %s", argv[0], fr_syserror(errno));
+#endif
+}
+
+/** Read programs to start from the server, until it goes away
+ *
+ * Each message is three uint32_ts: the length of the rest of the
+ * message, the number of arguments, and the number of environment
+ * variables.  They're followed by the arguments, then the
+ * environment variables, each NUL terminated.
+ */
+static void NEVER_RETURNS launcher_run(int fd)
+{
+	bool		debug = (rad_debug_lvl > 0);
+	uint32_t	hdr[3];
+
+	/*
+	 *	Don't hold on to any of the server's files.
+	 */
+	if (fd != 3) {
+		if (dup2(fd, 3) < 0) _exit(1);
+		fd = 3;
+	}
+	closefrom(4);
+	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (launcher_read(fd, hdr, sizeof(hdr)) > 0) {
+		char		*buff, *p, *end;
+		char		**argv, **envp;
+		uint32_t	i;
+
+		if ((hdr[0] == 0) || (hdr[0] > LAUNCHER_MAX_MSG) || (hdr[1] == 0) ||
+		    ((hdr[1] + hdr[2]) > hdr[0])) break;
+
+		MEM(buff = talloc_array(NULL, char, hdr[0]));
+		if (launcher_read(fd, buff, hdr[0]) <= 0) break;
+
+		MEM(argv = talloc_zero_array(buff, char *, hdr[1] + 1));
+		MEM(envp = talloc_zero_array(buff, char *, hdr[2] + 1));
+
+		p = buff;
+		end = buff + hdr[0];
+		for (i = 0; i < (hdr[1] + hdr[2]); i++) {
+			char *q;
+
+			q = memchr(p, '\0', end - p);
+			if (!q) break;
+
+			if (i < hdr[1]) {
+				argv[i] = p;
+			} else {
+				envp[i - hdr[1]] = p;
+			}
+			p = q + 1;
+		}
+
+		if (i == (hdr[1] + hdr[2])) launcher_spawn(argv, envp, debug);
+
+		talloc_free(buff);
+	}
+
+	_exit(0);
+}
+
+/** Start the launcher process
+ *
+ * Must be called before any threads are started.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int radius_exec_launcher_start(void)
+{
+	int	sv[2];
+	pid_t	pid;
+
+	if (launcher_fd >= 0) return 0;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		ERROR("Failed creating socket for launcher: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		ERROR("Failed forking launcher: %s", fr_syserror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		close(sv[0]);
+		launcher_run(sv[1]);
+	}
+
+	close(sv[1]);
+	(void) fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+
+	launcher_fd = sv[0];
+	launcher_pid = pid;
+
+	DEBUG2("Started launcher process %u", (unsigned int) pid);
+
+	return 0;
+}
+
+/** Stop the launcher process
+ *
+ * Programs it has started are left running.
+ */
+void radius_exec_launcher_stop(void)
+{
+	int status;
+
+	if (launcher_fd < 0) return;
+
+	close(launcher_fd);
+	launcher_fd = -1;
+
+	/*
+	 *	It exits when it sees the socket close.  If we've
+	 *	forked since it was started, it's not our child.
+	 */
+	if (launcher_pid > 0) (void) waitpid(launcher_pid, &status, 0);
+	launcher_pid = -1;
+}
+
+/** Ask the launcher to start a program
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the program should be started by forking.
+ */
+static int launcher_send(char **argv, char **envp)
+{
+	uint32_t	hdr[3];
+	size_t		len = 0;
+	int		i, argc, envc;
+	uint8_t		*msg, *p, *end;
+
+	for (argc = 0; argv[argc]; argc++) len += strlen(argv[argc]) + 1;
+	for (envc = 0; envp[envc]; envc++) len += strlen(envp[envc]) + 1;
+
+	if (len > LAUNCHER_MAX_MSG) return -1;
+
+	hdr[0] = len;
+	hdr[1] = argc;
+	hdr[2] = envc;
+
+	MEM(msg = talloc_array(NULL, uint8_t, sizeof(hdr) + len));
+	memcpy(msg, hdr, sizeof(hdr));
+	p = msg + sizeof(hdr);
+	for (i = 0; i < (argc + envc); i++) {
+		char const	*str = (i < argc) ? argv[i] : envp[i - argc];
+		size_t		str_len = strlen(str) + 1;
+
+		memcpy(p, str, str_len);
+		p += str_len;
+	}
+	end = p;
+
+	/*
+	 *	Messages from different threads mustn't be interleaved.
+	 */
+	pthread_mutex_lock(&launcher_mutex);
+	if (launcher_fd < 0) {
+		pthread_mutex_unlock(&launcher_mutex);
+		talloc_free(msg);
+		return -1;
+	}
+
+	for (p = msg; p < end; ) {
+		ssize_t slen;
+
+		slen = write(launcher_fd, p, end - p);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+
+			/*
+			 *	The launcher has gone away.  Start
+			 *	programs ourselves from now on.
+			 */
+			ERROR("Failed writing to launcher: %s", fr_syserror(errno));
+			close(launcher_fd);
+			launcher_fd = -1;
+			break;
+		}
+		p += slen;
+	}
+	pthread_mutex_unlock(&launcher_mutex);
+
+	talloc_free(msg);
+
+	return (p == end) ? 0 : -1;
+}
+#endif
+
 /** Start a process
  *
  * @param cmd Command to execute. This is parsed into argv[] parts, then each individual argv
@@ -184,6 +487,16 @@ pid_t radius_start_program(char const *cmd, REQUEST *request, bool exec_wait,
 		envp[envlen] = NULL;
 	}
 
+	/*
+	 *	Nothing to hand back, so the launcher can start it.
+	 */
+	if (!exec_wait && (launcher_fd >= 0)) {
+		if (launcher_send(argv, envp) == 0) {
+			talloc_free(input_ctx);
+			return 0;
+		}
+	}
+
 	if (exec_wait) {
 		pid = rad_fork();	/* remember PID */
 	} else {
@@ -2,17 +2,22 @@ TARGET	:= libfreeradius-server.a
 
 SOURCES	:=	cond_eval.c \
 		cond_tokenize.c \
+		cf_cache.c \
 		cf_file.c \
 		cf_parse.c \
 		cf_util.c \
 		connection.c \
+		detail.c \
 		dl.c \
 		exec.c \
 		exfile.c \
 		log.c \
+		mapfile.c \
+		startup_trace.c \
 		map_proc.c \
 		map.c \
 		regex.c \
+		reload.c \
 		request.c \
 		trigger.c \
 		tmpl.c \
@@ -492,21 +492,21 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 		 *	can be defined.
 		 */
 		rad_assert(client->dynamic == 0);
-
-	} else if (!client->dynamic && client->rate_limit) {
-		/*
-		 *	The IP is unknown, so we've found an enclosing
-		 *	network.  Enable DoS protection.  We only
-		 *	allow one new client per second.  Known
-		 *	clients aren't subject to this restriction.
-		 */
-		if (now == client->last_new_client) goto unknown;
 	}
 
+	/*
+	 *	The IP is unknown, so we've found an enclosing
+	 *	network.  Enable DoS protection.  Addresses which
+	 *	are already being looked up, or which recently failed
+	 *	to be, are dropped, as are lookups over the network's
+	 *	rate limit.  Known clients aren't subject to this.
+	 */
+	if (!client_admit(client, ipaddr, now)) goto unknown;
+
 	client->last_new_client = now;
 
 	request = request_alloc(NULL);
-	if (!request) goto unknown;
+	if (!request) goto failed;
 
 	request->listener = listener;
 	request->client = client;
@@ -514,13 +514,13 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 	if (!request->packet) {				/* badly formed, etc */
 		talloc_free(request);
 		if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
-		goto unknown;
+		goto failed;
 	}
 	(void) talloc_steal(request, request->packet);
 	request->reply = fr_radius_alloc_reply(request, request->packet);
 	if (!request->reply) {
 		talloc_free(request);
-		goto unknown;
+		goto failed;
 	}
 	request->number = 0;
 	request->priority = listener->type;
@@ -555,7 +555,7 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 		      cf_section_name2(request->server_cs),
 		      fr_int2str(mod_rcode_table, rcode, "<INVALID>"));
 		talloc_free(request);
-		goto unknown;
+		goto failed;
 
 	/*
 	 *	Probably the result of policy, or the client not existing.
@@ -564,7 +564,7 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 		DEBUG("Virtual-Server %s returned %s, ignoring client", cf_section_name2(request->server_cs),
 		      fr_int2str(mod_rcode_table, rcode, "<INVALID>"));
 		talloc_free(request);
-		goto unknown;
+		goto failed;
 	}
 
 	/*
@@ -579,7 +579,7 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 		/*
 		 *	This frees the client if it isn't valid.
 		 */
-		if (!client_add_dynamic(clients, client, created)) goto unknown;
+		if (!client_add_dynamic(clients, client, created)) goto failed;
 	}
 
 	request->server_cs = client->server_cs;
@@ -588,7 +588,13 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 
 	talloc_free(request);
 
-	if (!created) goto unknown;
+	if (!created) {
+	failed:
+		client_admit_done(client, ipaddr, false, now);
+		goto unknown;
+	}
+
+	client_admit_done(client, ipaddr, true, now);
 
 	return created;
 #endif
@@ -1688,7 +1694,7 @@ static int stats_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-	FR_STATS_TYPE_INC(client->auth.total_requests);
+	FR_STATS_TYPE_INC(client->stats_id, auth, total_requests);
 
 	/*
 	 *	We only understand Status-Server on this socket.
@@ -1758,7 +1764,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-	FR_STATS_TYPE_INC(client->auth.total_requests);
+	FR_STATS_TYPE_INC(client->stats_id, auth, total_requests);
 
 	/*
 	 *	Some sanity checks, based on the packet code.
@@ -1872,7 +1878,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-	FR_STATS_TYPE_INC(client->acct.total_requests);
+	FR_STATS_TYPE_INC(client->stats_id, acct, total_requests);
 
 	/*
 	 *	Some sanity checks, based on the packet code.
@@ -2244,7 +2250,7 @@ static int proxy_socket_recv(rad_listen_t *listener)
 		      fr_inet_ntoh(&packet->src_ipaddr, buffer, sizeof(buffer)),
 		      packet->src_port, packet->id);
 #  ifdef WITH_STATS
-		listener->stats.total_unknown_types++;
+		FR_STATS_TYPE_INC(listener->stats_id, auth, total_unknown_types);
 #  endif
 		fr_radius_free(&packet);
 		return 0;
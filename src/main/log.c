@@ -226,6 +226,7 @@ void vradlog_request(fr_log_type_t type, fr_log_lvl_t lvl, REQUEST *request, cha
 {
 	char const	*filename;
 	FILE		*fp = NULL;
+	char		*async_file = NULL;
 
 	char		*p;
 	char const	*extra = "";
@@ -263,6 +264,14 @@ void vradlog_request(fr_log_type_t type, fr_log_lvl_t lvl, REQUEST *request, cha
 		 */
 		switch (log_dst->dst) {
 		case L_DST_FILES:
+			/*
+			 *	The writer thread appends it to the file.
+			 */
+			if (fr_log_async_enabled()) {
+				async_file = talloc_typed_strdup(request, log_dst->file);
+				break;
+			}
+
 			fp = fopen(log_dst->file, "a");
 			if (!fp) goto finish;
 			break;
@@ -334,8 +343,12 @@ void vradlog_request(fr_log_type_t type, fr_log_lvl_t lvl, REQUEST *request, cha
 			*p = FR_DIR_SEP;
 		}
 
-		fp = fopen(exp, "a");
-		talloc_free(exp);
+		if (fr_log_async_enabled()) {
+			async_file = exp;
+		} else {
+			fp = fopen(exp, "a");
+			talloc_free(exp);
+		}
 	}
 
 print_msg:
@@ -385,9 +398,9 @@ print_msg:
 	va_end(aq);
 
 	/*
-	 *	Logging to a file descriptor
+	 *	Logging to a file
 	 */
-	if (fp) {
+	if (fp || async_file) {
 		char time_buff[64];	/* The current timestamp */
 
 		time_t timeval;
@@ -410,6 +423,29 @@ print_msg:
 		p = strrchr(time_buff, '\n');
 		if (p) p[0] = '\0';
 
+		if (async_file) {
+			char *line;
+
+			line = talloc_asprintf(request, "%s" "%s : " "%s" "%.*s" "%s" "%s" "\n",
+					       msg_prefix,
+					       time_buff,
+					       fr_int2str(fr_log_levels, type, ""),
+					       unlang_indent, spaces,
+					       msg_module ? msg_module : "",
+					       msg_exp);
+			if (line && (fr_log_async_write(log_dst, 0, async_file, line, talloc_array_length(line) - 1) >= 0)) {
+				talloc_free(line);
+				goto finish;
+			}
+			talloc_free(line);
+
+			/*
+			 *	The writer has stopped.  Write it ourselves.
+			 */
+			fp = fopen(async_file, "a");
+			if (!fp) goto finish;
+		}
+
 		fprintf(fp, "%s" "%s : " "%s" "%.*s" "%s" "%s" "\n",
 			msg_prefix,
 			time_buff,
@@ -447,6 +483,7 @@ print_msg:
 		      msg_exp);
 
 finish:
+	talloc_free(async_file);
 	talloc_free(msg_exp);
 	talloc_free(msg_module);
 	talloc_free(msg_prefix);
@@ -28,6 +28,8 @@ RCSID("$Id$")
 #include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/map_proc.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/startup_trace.h>
+#include <freeradius-devel/io/ring_buffer.h>
 
 #include <sys/stat.h>
 #include <pwd.h>
@@ -140,6 +142,13 @@ static const CONF_PARSER initial_logging_config[] = {
  *	items, we can parse the rest of the configuration items.
  *
  **********************************************************************/
+static const CONF_PARSER log_async_config[] = {
+	{ FR_CONF_POINTER("enable", FR_TYPE_BOOL, &main_config.log_async), .dflt = "no" },
+	{ FR_CONF_POINTER("ring_size", FR_TYPE_SIZE, &main_config.log_async_ring_size), .dflt = "1048576" },
+	{ FR_CONF_POINTER("overflow", FR_TYPE_STRING, &main_config.log_async_overflow), .dflt = "drop" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER log_config[] = {
 	{ FR_CONF_POINTER("stripped_names", FR_TYPE_BOOL, &log_stripped_names), .dflt = "no" },
 	{ FR_CONF_POINTER("auth", FR_TYPE_BOOL, &main_config.log_auth), .dflt = "no" },
@@ -151,6 +160,7 @@ static const CONF_PARSER log_config[] = {
 	{ FR_CONF_POINTER("timestamp", FR_TYPE_BOOL, &log_timestamp) },
 	{ FR_CONF_POINTER("use_utc", FR_TYPE_BOOL, &log_dates_utc) },
 	{ FR_CONF_POINTER("msg_denied", FR_TYPE_STRING, &main_config.denied_msg), .dflt = "You are already logged in - access denied" },
+	{ FR_CONF_POINTER("async", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) log_async_config },
 #ifdef WITH_CONF_WRITE
 	{ FR_CONF_POINTER("write_dir", FR_TYPE_STRING, &main_config.write_dir), .dflt = NULL },
 #endif
@@ -170,6 +180,61 @@ static const CONF_PARSER resources[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+/*
+ *	Network and worker threads for the new listeners.
+ */
+static fr_schedule_config_t schedule_config;
+static char const *hugepages_str = NULL;
+
+static const FR_NAME_NUMBER hugepages_table[] = {
+	{ "no",			FR_RING_BUFFER_PAGES_NORMAL },
+	{ "transparent",	FR_RING_BUFFER_PAGES_TRANSPARENT },
+	{ "yes",		FR_RING_BUFFER_PAGES_HUGE },
+	{ NULL, 0 }
+};
+
+static const CONF_PARSER thread_config[] = {
+	{ FR_CONF_POINTER("network_cpus", FR_TYPE_STRING, &schedule_config.network_cpus) },
+	{ FR_CONF_POINTER("worker_cpus", FR_TYPE_STRING, &schedule_config.worker_cpus) },
+	{ FR_CONF_POINTER("numa", FR_TYPE_BOOL, &schedule_config.numa), .dflt = "no" },
+	{ FR_CONF_POINTER("num_networks", FR_TYPE_UINT32, &schedule_config.num_networks), .dflt = "1" },
+	{ FR_CONF_POINTER("num_workers", FR_TYPE_UINT32, &schedule_config.num_workers), .dflt = "4" },
+	{ FR_CONF_POINTER("min_workers", FR_TYPE_UINT32, &schedule_config.min_workers), .dflt = "0" },
+	{ FR_CONF_POINTER("max_workers", FR_TYPE_UINT32, &schedule_config.max_workers), .dflt = "0" },
+	{ FR_CONF_POINTER("scale_up", FR_TYPE_UINT32, &schedule_config.scale_up), .dflt = "75" },
+	{ FR_CONF_POINTER("scale_down", FR_TYPE_UINT32, &schedule_config.scale_down), .dflt = "25" },
+	{ FR_CONF_POINTER("scale_interval", FR_TYPE_TIMEVAL, &schedule_config.scale_interval), .dflt = "1" },
+	{ FR_CONF_POINTER("hugepages", FR_TYPE_STRING, &hugepages_str), .dflt = "no" },
+	{ FR_CONF_POINTER("num_instantiate", FR_TYPE_UINT32, &main_config.num_instantiate), .dflt = "4" },
+#ifdef WITH_TLS
+	{ FR_CONF_POINTER("num_crypto", FR_TYPE_UINT32, &main_config.num_crypto), .dflt = "0" },
+#endif
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER metrics_config[] = {
+	{ FR_CONF_POINTER("listen", FR_TYPE_STRING, &main_config.metrics_listen) },
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER tracing_config[] = {
+	{ FR_CONF_POINTER("endpoint", FR_TYPE_STRING, &main_config.trace_endpoint) },
+	{ FR_CONF_POINTER("sample_rate", FR_TYPE_UINT32, &main_config.trace_sample_rate), .dflt = "1000" },
+	{ FR_CONF_POINTER("service_name", FR_TYPE_STRING, &main_config.trace_service_name), .dflt = "freeradius" },
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER memory_state_config[] = {
+	{ FR_CONF_POINTER("soft_limit", FR_TYPE_SIZE, &main_config.state_soft_limit), .dflt = "0" },
+	{ FR_CONF_POINTER("hard_limit", FR_TYPE_SIZE, &main_config.state_hard_limit), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER memory_config[] = {
+	{ FR_CONF_POINTER("state", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) memory_state_config },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER server_config[] = {
 	/*
 	 *	FIXME: 'prefix' is the ONLY one which should be
@@ -203,6 +268,14 @@ static const CONF_PARSER server_config[] = {
 
 	{ FR_CONF_POINTER("resources", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) resources },
 
+	{ FR_CONF_POINTER("thread", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) thread_config },
+
+	{ FR_CONF_POINTER("metrics", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) metrics_config },
+
+	{ FR_CONF_POINTER("tracing", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) tracing_config },
+
+	{ FR_CONF_POINTER("memory", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) memory_config },
+
 	/*
 	 *	People with old configs will have these.  They are listed
 	 *	AFTER the "log" section, so if they exist in radiusd.conf,
@@ -673,6 +746,72 @@ char const *get_radius_dir(void)
 	return radius_dir;
 }
 
+/** Read the configuration files
+ *
+ * @return
+ *	- The root of the configuration.
+ *	- NULL on error.
+ */
+static CONF_SECTION *main_config_read(void)
+{
+	CONF_SECTION	*cs, *subcs;
+	char		buffer[1024];
+	int		ret;
+
+	cs = cf_section_alloc(NULL, NULL, "main", NULL);
+	if (!cs) return NULL;
+
+	/*
+	 *	Add a 'feature' subsection off the main config
+	 *	We check if it's defined first, as the user may
+	 *	have defined their own feature flags, or want
+	 *	to manually override the ones set by modules
+	 *	or the server.
+	 */
+	subcs = cf_section_find(cs, "feature", NULL);
+	if (!subcs) {
+		subcs = cf_section_alloc(cs, cs, "feature", NULL);
+		if (!subcs) {
+			talloc_free(cs);
+			return NULL;
+		}
+
+		cf_section_add(cs, subcs);
+	}
+	version_init_features(subcs);
+
+	/*
+	 *	Add a 'version' subsection off the main config
+	 *	We check if it's defined first, this is for
+	 *	backwards compatibility.
+	 */
+	subcs = cf_section_find(cs, "version", NULL);
+	if (!subcs) {
+		subcs = cf_section_alloc(cs, cs, "version", NULL);
+		if (!subcs) {
+			talloc_free(cs);
+			return NULL;
+		}
+		cf_section_add(cs, subcs);
+	}
+	version_numbers_init(subcs);
+
+	/* Read the configuration file */
+	snprintf(buffer, sizeof(buffer), "%.200s/%.50s.conf", radius_dir, main_config.name);
+	if (main_config.config_cache) {
+		ret = cf_file_read_cached(cs, buffer, main_config.config_cache);
+	} else {
+		ret = cf_file_read(cs, buffer);
+	}
+	if (ret < 0) {
+		ERROR("Error reading or parsing %s", buffer);
+		talloc_free(cs);
+		return NULL;
+	}
+
+	return cs;
+}
+
 /*
  *	Read config files.
  *
@@ -681,10 +820,10 @@ char const *get_radius_dir(void)
 int main_config_init(void)
 {
 	char const		*p = NULL;
-	CONF_SECTION		*cs, *subcs;
+	CONF_SECTION		*cs;
 	struct stat		statbuf;
 	cached_config_t 	*cc;
-	char			buffer[1024];
+	fr_startup_phase_t	*trace;
 
 	if (stat(radius_dir, &statbuf) < 0) {
 		ERROR("Error reading %s: %s",
@@ -728,6 +867,7 @@ int main_config_init(void)
 	 *	Read the distribution dictionaries first, then
 	 *	the ones in raddb.
 	 */
+	trace = fr_startup_trace_start("dictionary", NULL);
 	DEBUG2("Including dictionary file \"%s/%s\"", main_config.dictionary_dir, FR_DICTIONARY_FILE);
 	if (fr_dict_from_file(NULL, &main_config.dict, main_config.dictionary_dir, FR_DICTIONARY_FILE, "radius") != 0) {
 		ERROR("Errors reading dictionary: %s",
@@ -753,46 +893,12 @@ do {\
 	 *	It's OK if this one doesn't exist.
 	 */
 	DICT_READ_OPTIONAL(radius_dir, FR_DICTIONARY_FILE);
+	fr_startup_trace_stop(trace);
 
-	cs = cf_section_alloc(NULL, NULL, "main", NULL);
+	trace = fr_startup_trace_start("config", NULL);
+	cs = main_config_read();
 	if (!cs) return -1;
-
-	/*
-	 *	Add a 'feature' subsection off the main config
-	 *	We check if it's defined first, as the user may
-	 *	have defined their own feature flags, or want
-	 *	to manually override the ones set by modules
-	 *	or the server.
-	 */
-	subcs = cf_section_find(cs, "feature", NULL);
-	if (!subcs) {
-		subcs = cf_section_alloc(cs, cs, "feature", NULL);
-		if (!subcs) return -1;
-
-		cf_section_add(cs, subcs);
-	}
-	version_init_features(subcs);
-
-	/*
-	 *	Add a 'version' subsection off the main config
-	 *	We check if it's defined first, this is for
-	 *	backwards compatibility.
-	 */
-	subcs = cf_section_find(cs, "version", NULL);
-	if (!subcs) {
-		subcs = cf_section_alloc(cs, cs, "version", NULL);
-		if (!subcs) return -1;
-		cf_section_add(cs, subcs);
-	}
-	version_numbers_init(subcs);
-
-	/* Read the configuration file */
-	snprintf(buffer, sizeof(buffer), "%.200s/%.50s.conf", radius_dir, main_config.name);
-	if (cf_file_read(cs, buffer) < 0) {
-		ERROR("Error reading or parsing %s", buffer);
-		talloc_free(cs);
-		return -1;
-	}
+	fr_startup_trace_stop(trace);
 
 	/*
 	 *	If there was no log destination set on the command line,
@@ -889,6 +995,8 @@ do {\
 	if (cf_section_rules_push(cs, virtual_servers_config) < 0) return -1;
 	if (cf_section_parse(NULL, NULL, cs) < 0) return -1;
 
+	main_config.schedule = &schedule_config;
+
 	/*
 	 *	We ignore colourization of output until after the
 	 *	configuration files have been parsed.
@@ -928,8 +1036,51 @@ do {\
 
 	FR_INTEGER_BOUND_CHECK("cleanup_delay", main_config.cleanup_delay, <=, 10);
 
+	FR_INTEGER_BOUND_CHECK("thread.num_networks", schedule_config.num_networks, >=, 1);
+	FR_INTEGER_BOUND_CHECK("thread.num_networks", schedule_config.num_networks, <=, 64);
+
+	FR_INTEGER_BOUND_CHECK("thread.num_workers", schedule_config.num_workers, >=, 1);
+	FR_INTEGER_BOUND_CHECK("thread.num_workers", schedule_config.num_workers, <=, 128);
+	FR_INTEGER_BOUND_CHECK("thread.max_workers", schedule_config.max_workers, <=, 128);
+	FR_INTEGER_BOUND_CHECK("thread.num_instantiate", main_config.num_instantiate, >=, 1);
+	FR_INTEGER_BOUND_CHECK("thread.num_instantiate", main_config.num_instantiate, <=, 64);
+#ifdef WITH_TLS
+	FR_INTEGER_BOUND_CHECK("thread.num_crypto", main_config.num_crypto, <=, 128);
+#endif
+	FR_INTEGER_BOUND_CHECK("thread.scale_up", schedule_config.scale_up, <=, 100);
+	FR_INTEGER_BOUND_CHECK("thread.scale_down", schedule_config.scale_down, <=, schedule_config.scale_up);
+	FR_TIMEVAL_BOUND_CHECK("thread.scale_interval", &schedule_config.scale_interval, >=, 0, 100000);
+	FR_TIMEVAL_BOUND_CHECK("thread.scale_interval", &schedule_config.scale_interval, <=, 60, 0);
+
+	{
+		int pages;
+
+		pages = fr_str2int(hugepages_table, hugepages_str, -1);
+		if (pages < 0) {
+			ERROR("Invalid value for thread.hugepages '%s'", hugepages_str);
+			return -1;
+		}
+		fr_ring_buffer_pages_set(pages);
+	}
+
 	FR_TIMEVAL_BOUND_CHECK("reject_delay", &main_config.reject_delay, <=, main_config.cleanup_delay, 0);
 
+	FR_SIZE_BOUND_CHECK("log.async.ring_size", main_config.log_async_ring_size, >=, (size_t)(64 * 1024));
+	FR_SIZE_BOUND_CHECK("log.async.ring_size", main_config.log_async_ring_size, <=, (size_t)(256 * 1024 * 1024));
+
+	if (strcmp(main_config.log_async_overflow, "block") == 0) {
+		main_config.log_async_block = true;
+	} else if (strcmp(main_config.log_async_overflow, "drop") != 0) {
+		ERROR("Invalid value for log.async.overflow '%s'.  Must be 'drop' or 'block'",
+		      main_config.log_async_overflow);
+		return -1;
+	}
+
+	if (main_config.state_hard_limit && (main_config.state_soft_limit > main_config.state_hard_limit)) {
+		ERROR("memory.state.soft_limit must not be larger than memory.state.hard_limit");
+		return -1;
+	}
+
 	FR_SIZE_BOUND_CHECK("resources.talloc_pool_size", main_config.talloc_pool_size, >=, (size_t)(2 * 1024));
 	FR_SIZE_BOUND_CHECK("resources.talloc_pool_size", main_config.talloc_pool_size, <=, (size_t)(1024 * 1024));
 
@@ -960,9 +1111,11 @@ do {\
 	main_config.config = cs;
 
 	DEBUG2("%s: #### Loading Clients ####", main_config.name);
+	trace = fr_startup_trace_start("clients", NULL);
 	if (!client_list_parse_section(cs, false)) {
 		return -1;
 	}
+	fr_startup_trace_stop(trace);
 
 	/*
 	 *	Register the %{config:section.subsection} xlat function.
@@ -1048,9 +1201,54 @@ void hup_logfile(void)
 	}
 }
 
-void main_config_hup(void)
+/*
+ *	Called for each file which has changed.  Returns 1 if the file
+ *	was loaded by a module which will be reloaded.
+ */
+static int hup_callback(void *ctx, void *data)
+{
+	CONF_SECTION	*modules = ctx;
+	CONF_SECTION	*cs = data;
+	CONF_SECTION	*parent;
+
+	if (!modules) return 0;
+
+	/*
+	 *	Files may be defined in sub-sections of a module
+	 *	config.  Walk up the tree until we find the module
+	 *	definition.
+	 */
+	for (;;) {
+		parent = cf_item_to_section(cf_parent(cs));
+
+		/*
+		 *	Not a file loaded by a module.
+		 */
+		if (!parent) return 0;
+
+		if (parent == modules) break;
+		cs = parent;
+	}
+
+	return module_hup_pending(cf_section_find(main_config.config, "modules", NULL), cs);
+}
+
+/** Reload the configuration
+ *
+ * The configuration files are read again, as a new generation of the
+ * configuration.  Modules whose configuration is unchanged, or which
+ * can't be reloaded, carry on as they are.  The others get new
+ * instance data, and requests which are using the old instance data
+ * carry on with it until they're done.
+ *
+ * @param[in] el	of the main thread.
+ */
+void main_config_hup(fr_event_list_t *el)
 {
 	time_t		when;
+	int		rcode = CF_FILE_NONE;
+	CONF_SECTION	*cs;
+	cached_config_t	*cc;
 
 	static time_t	last_hup = 0;
 
@@ -1073,18 +1271,63 @@ void main_config_hup(void)
 	}
 	last_hup = when;
 
-#if 0
-	rcode = cf_file_changed(cs_cache->cs, hup_callback);
+	/*
+	 *	Files loaded by modules are in the configuration
+	 *	generation the module was last loaded from.  Only the
+	 *	newest generation is checked for configuration files.
+	 */
+	for (cc = cs_cache; cc; cc = cc->next) {
+		int changed;
+
+		changed = cf_file_changed(cc->cs, hup_callback);
+		if (cc == cs_cache) {
+			if (changed == CF_FILE_ERROR) {
+				INFO("HUP - Cannot read configuration files.  Ignoring");
+				return;
+			}
+
+			rcode = changed;
+			continue;
+		}
+
+		/*
+		 *	Older generations may refer to files which
+		 *	have since been removed.
+		 */
+		if (changed != CF_FILE_ERROR) rcode |= (changed & CF_FILE_MODULE);
+	}
+
 	if (rcode == CF_FILE_NONE) {
 		INFO("HUP - No files changed.  Ignoring");
 		return;
 	}
 
-	if (rcode == CF_FILE_ERROR) {
-		INFO("HUP - Cannot read configuration files.  Ignoring");
+	INFO("HUP - Re-reading configuration files");
+	cs = main_config_read();
+	if (!cs) {
+		ERROR("HUP - Failed re-reading configuration.  Using old configuration");
 		return;
 	}
-#endif
 
-	INFO("HUP - NYI in version 4");	/* Not yet implemented in v4 */
+	cc = talloc_zero(NULL, cached_config_t);
+	if (!cc) {
+		ERROR("Out of memory");
+		talloc_free(cs);
+		return;
+	}
+
+	/*
+	 *	Save the current configuration.  Older ones are kept,
+	 *	as modules which haven't been reloaded, and the
+	 *	virtual servers, still use them.
+	 */
+	cc->created = when;
+	cc->cs = talloc_steal(cc, cs);
+	cc->next = talloc_steal(cc, cs_cache);
+	cs_cache = cc;
+
+	INFO("HUP - Reloading modules");
+	if (modules_hup(cf_section_find(cs, "modules", NULL), el) < 0) {
+		ERROR("HUP - Some modules failed to reload, and are using their old configuration");
+	}
 }
@@ -767,6 +767,27 @@ int map_to_vp(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *request, vp_map_t cons
 		RDEBUG2("EXPAND %s", map->rhs->name);
 		RINDENT();
 
+		/*
+		 *	"%{Attr}" of the same type as the destination
+		 *	doesn't need to be printed and re-parsed.
+		 */
+		rcode = xlat_eval_compiled_box(n, &n->data, request, map->rhs->tmpl_xlat, n->vp_type);
+		if (rcode != 0) {
+			REXDENT();
+			if (rcode < 0) {
+				fr_pair_list_free(&n);
+				goto error;
+			}
+			n->data.enumv = n->da;	/* Print with the enums of the destination */
+
+			if (RDEBUG_ENABLED2) {
+				str = fr_pair_value_asprint(request, n, '\0');
+				RDEBUG2("--> %s", str);
+				talloc_free(str);
+			}
+			goto done_xlat_struct;
+		}
+
 		str = NULL;
 		slen = xlat_aeval_compiled(request, &str, request, map->rhs->tmpl_xlat, NULL, NULL);
 		REXDENT();
@@ -784,6 +805,8 @@ int map_to_vp(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *request, vp_map_t cons
 			fr_pair_list_free(&n);
 			goto error;
 		}
+
+	done_xlat_struct:
 		n->op = map->op;
 		n->tag = map->lhs->tmpl_tag;
 		*out = n;
@@ -0,0 +1,309 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file mapfile.c
+ * @brief Look up lines of a memory mapped text file by key.
+ *
+ * The file is mapped read-only, and never copied.  The index holds only
+ * the offset of each line, and the hash of its key, so it's much smaller
+ * than the file.  Lines are parsed by the caller when they're looked up.
+ *
+ * As only the hash is stored, a lookup can return lines which have a
+ * different key.  The caller must check the key of each line it gets.
+ *
+ * The file must not be changed while it's mapped.  Truncating it will
+ * crash the server.  It should be replaced by renaming a new file over
+ * it.
+ *
+ * @copyright 2026  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/mapfile.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct fr_mapfile_t {
+	uint8_t		*map;		//!< Of the whole file.  Read-only.
+	size_t		size;
+
+	uint64_t	line;		//!< Offset of the line which is being indexed.
+	bool		failed;		//!< Ran out of memory adding keys.
+
+	uint64_t	*offsets;	//!< Of the line, for each key.
+	uint32_t	*hashes;	//!< Of each key.
+	uint32_t	num_keys;
+	uint32_t	max_keys;	//!< Allocated in "offsets" and "hashes".
+
+	uint32_t	*slots;		//!< Open addressing table.  Key number + 1, or 0 if empty.
+	uint32_t	mask;		//!< Number of slots - 1.
+};
+
+static int _mapfile_free(fr_mapfile_t *mf)
+{
+	if (mf->map) munmap(mf->map, mf->size);
+
+	return 0;
+}
+
+/** Add a key for the current line
+ *
+ * May only be called from the key callback.  The key can be anywhere,
+ * as only its hash is kept.
+ *
+ * @param[in] mf	being indexed.
+ * @param[in] key	the line should be found by.
+ * @param[in] key_len	of the key.
+ */
+void fr_mapfile_add(fr_mapfile_t *mf, char const *key, size_t key_len)
+{
+	if (mf->failed) return;
+
+	if (mf->num_keys == mf->max_keys) {
+		uint32_t	max = mf->max_keys ? mf->max_keys * 2 : 1024;
+		uint64_t	*offsets;
+		uint32_t	*hashes;
+
+		/*
+		 *	Leave room for the slots to be twice the
+		 *	number of keys.
+		 */
+		if (max > (UINT32_MAX / 4)) {
+			mf->failed = true;
+			return;
+		}
+
+		offsets = talloc_realloc(mf, mf->offsets, uint64_t, max);
+		if (!offsets) {
+			mf->failed = true;
+			return;
+		}
+		mf->offsets = offsets;
+
+		hashes = talloc_realloc(mf, mf->hashes, uint32_t, max);
+		if (!hashes) {
+			mf->failed = true;
+			return;
+		}
+		mf->hashes = hashes;
+
+		mf->max_keys = max;
+	}
+
+	mf->offsets[mf->num_keys] = mf->line;
+	mf->hashes[mf->num_keys] = fr_hash(key, key_len);
+	mf->num_keys++;
+}
+
+/** Find the end of the line which starts at "offset"
+ *
+ * @return the length of the line, not including "\n" or "\r\n".
+ */
+static size_t mapfile_line_len(fr_mapfile_t const *mf, uint64_t offset, size_t *next)
+{
+	uint8_t const	*p = mf->map + offset;
+	uint8_t const	*nl;
+	size_t		len;
+
+	nl = memchr(p, '\n', mf->size - offset);
+	len = nl ? (size_t) (nl - p) : mf->size - offset;
+	if (next) *next = offset + len + (nl != NULL);
+
+	if (len && (p[len - 1] == '\r')) len--;
+
+	return len;
+}
+
+/** Map a file, and index its lines
+ *
+ * @param[in] ctx	to allocate the index in.  The file is unmapped
+ *			when the index is freed.
+ * @param[in] filename	to map.
+ * @param[in] key	called for each line, to find its keys.
+ * @param[in] uctx	passed to the key callback.
+ * @return
+ *	- The index.
+ *	- NULL on error.
+ */
+fr_mapfile_t *fr_mapfile_alloc(TALLOC_CTX *ctx, char const *filename, fr_mapfile_key_t key, void *uctx)
+{
+	fr_mapfile_t	*mf;
+	int		fd;
+	struct stat	st;
+	size_t		offset, next;
+	uint64_t	lineno = 0;
+	uint32_t	num_slots, i;
+
+	mf = talloc_zero(ctx, fr_mapfile_t);
+	if (!mf) return NULL;
+	talloc_set_destructor(mf, _mapfile_free);
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening %s: %s", filename, fr_syserror(errno));
+		talloc_free(mf);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		fr_strerror_printf("Failed to stat %s: %s", filename, fr_syserror(errno));
+		close(fd);
+		talloc_free(mf);
+		return NULL;
+	}
+
+	if (st.st_size > 0) {
+		void *map;
+
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			fr_strerror_printf("Failed mapping %s: %s", filename, fr_syserror(errno));
+			close(fd);
+			talloc_free(mf);
+			return NULL;
+		}
+		mf->map = map;
+		mf->size = st.st_size;
+	}
+	close(fd);
+
+#ifdef MADV_SEQUENTIAL
+	if (mf->map) (void) madvise(mf->map, mf->size, MADV_SEQUENTIAL);
+#endif
+
+	for (offset = 0; offset < mf->size; offset = next) {
+		size_t len;
+
+		len = mapfile_line_len(mf, offset, &next);
+		lineno++;
+
+		mf->line = offset;
+		if (key(mf, (char const *) mf->map + offset, len, lineno, uctx) < 0) {
+			talloc_free(mf);
+			return NULL;
+		}
+
+		if (mf->failed) {
+			fr_strerror_printf("Out of memory indexing %s at line %" PRIu64, filename, lineno);
+			talloc_free(mf);
+			return NULL;
+		}
+	}
+
+	/*
+	 *	Lookups jump around the file.
+	 */
+#ifdef MADV_RANDOM
+	if (mf->map) (void) madvise(mf->map, mf->size, MADV_RANDOM);
+#endif
+
+	if (!mf->num_keys) return mf;
+
+	/*
+	 *	No more keys are going to be added.
+	 */
+	MEM(mf->offsets = talloc_realloc(mf, mf->offsets, uint64_t, mf->num_keys));
+	MEM(mf->hashes = talloc_realloc(mf, mf->hashes, uint32_t, mf->num_keys));
+
+	/*
+	 *	At most half full, so the runs of slots a lookup has
+	 *	to look through are short.  Keys with the same hash
+	 *	are found in the order they're in the file.
+	 */
+	for (num_slots = 16; num_slots < (mf->num_keys * 2); num_slots <<= 1);
+
+	mf->slots = talloc_zero_array(mf, uint32_t, num_slots);
+	if (!mf->slots) {
+		fr_strerror_printf("Out of memory indexing %s", filename);
+		talloc_free(mf);
+		return NULL;
+	}
+	mf->mask = num_slots - 1;
+
+	for (i = 0; i < mf->num_keys; i++) {
+		uint32_t slot = mf->hashes[i] & mf->mask;
+
+		while (mf->slots[slot]) slot = (slot + 1) & mf->mask;
+
+		mf->slots[slot] = i + 1;
+	}
+
+	return mf;
+}
+
+/** Return the number of keys in the index
+ *
+ */
+uint64_t fr_mapfile_num_keys(fr_mapfile_t const *mf)
+{
+	return mf->num_keys;
+}
+
+/** Return the next line which might have the key
+ *
+ * @param[in] mf	to look in.
+ * @param[in] cursor	from fr_mapfile_find().
+ * @param[out] len	of the line, not including the end of line.
+ * @return
+ *	- The start of the line.  It's not '\\0' terminated.
+ *	- NULL if there are no more lines.
+ */
+char const *fr_mapfile_next(fr_mapfile_t const *mf, fr_mapfile_cursor_t *cursor, size_t *len)
+{
+	if (!mf->slots) return NULL;
+
+	while (mf->slots[cursor->slot]) {
+		uint32_t i = mf->slots[cursor->slot] - 1;
+
+		cursor->slot = (cursor->slot + 1) & mf->mask;
+
+		if (mf->hashes[i] != cursor->hash) continue;
+
+		*len = mapfile_line_len(mf, mf->offsets[i], NULL);
+		return (char const *) mf->map + mf->offsets[i];
+	}
+
+	return NULL;
+}
+
+/** Return the first line which might have the key
+ *
+ * The caller must check that the line does have the key, and call
+ * fr_mapfile_next() to get the next line if it doesn't.
+ *
+ * @param[in] mf	to look in.
+ * @param[out] cursor	for fr_mapfile_next().
+ * @param[in] key	to look for.
+ * @param[in] key_len	of the key.
+ * @param[out] len	of the line, not including the end of line.
+ * @return
+ *	- The start of the line.  It's not '\\0' terminated.
+ *	- NULL if there are no lines with the key.
+ */
+char const *fr_mapfile_find(fr_mapfile_t const *mf, fr_mapfile_cursor_t *cursor,
+			    char const *key, size_t key_len, size_t *len)
+{
+	cursor->hash = fr_hash(key, key_len);
+	cursor->slot = cursor->hash & mf->mask;
+
+	return fr_mapfile_next(mf, cursor, len);
+}
@@ -0,0 +1,376 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file metrics.c
+ * @brief Serve the server's metrics over HTTP, in OpenMetrics (Prometheus) format.
+ *
+ * The listeners, clients, modules and home servers keep their own
+ * counters (see io/metrics.c), which are only added up here, when
+ * the metrics are requested.  The network and worker threads are asked
+ * for a snapshot of their statistics, and their latency histograms are
+ * read while they run.
+ *
+ * The HTTP server runs in the main event loop, and is as simple as it
+ * can be.  It ignores whatever was requested, and returns the metrics.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/io/metrics.h>
+
+#define METRICS_TIMEOUT	1	//!< How long we wait for an HTTP client, in seconds.
+
+static char const metrics_type[] = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+
+static int metrics_sockfd = -1;
+
+/** A counter or gauge from fr_worker_stats_t
+ *
+ */
+typedef struct {
+	char const	*name;				//!< Of the metric family.
+	bool		counter;			//!< Or a gauge.
+	char const	*help;
+	size_t		offset;				//!< Of the int in fr_worker_stats_t.
+} metrics_worker_field_t;
+
+static metrics_worker_field_t const worker_fields[] = {
+	{ "freeradius_worker_requests", true, "Requests processed by the worker.",
+	  offsetof(fr_worker_stats_t, num_requests) },
+	{ "freeradius_worker_replies", true, "Replies sent by the worker.",
+	  offsetof(fr_worker_stats_t, num_replies) },
+	{ "freeradius_worker_timeouts", true, "Requests which took too long to process.",
+	  offsetof(fr_worker_stats_t, num_timeouts) },
+	{ "freeradius_worker_expired", true, "Requests dropped because they were past their deadline.",
+	  offsetof(fr_worker_stats_t, num_expired) },
+	{ "freeradius_worker_stolen", true, "Requests taken from other workers.",
+	  offsetof(fr_worker_stats_t, num_stolen) },
+	{ "freeradius_worker_pool_overflows", true, "Requests which needed more memory than their talloc pool had.",
+	  offsetof(fr_worker_stats_t, num_pool_overflows) },
+	{ "freeradius_worker_channels", false, "Channels from network threads.",
+	  offsetof(fr_worker_stats_t, num_channels) },
+	{ "freeradius_worker_to_decode", false, "Messages waiting to be decoded.",
+	  offsetof(fr_worker_stats_t, to_decode) },
+	{ "freeradius_worker_runnable", false, "Requests which are ready to run.",
+	  offsetof(fr_worker_stats_t, runnable) },
+};
+
+static char const *worker_stages[FR_WORKER_LATENCY_MAX] = {
+	[FR_WORKER_LATENCY_QUEUED] = "queued",
+	[FR_WORKER_LATENCY_DECODE] = "decode",
+	[FR_WORKER_LATENCY_RUNNING] = "running",
+	[FR_WORKER_LATENCY_YIELDED] = "yielded",
+	[FR_WORKER_LATENCY_TOTAL] = "total",
+};
+
+static char const *network_drops[FR_NETWORK_DROP_MAX] = {
+	[FR_NETWORK_DROP_NO_WORKERS] = "no_workers",
+	[FR_NETWORK_DROP_OVERLOAD] = "overload",
+	[FR_NETWORK_DROP_CHANNEL_FULL] = "channel_full",
+	[FR_NETWORK_DROP_RATE_LIMIT] = "rate_limit",
+};
+
+/** Append the header of a metric family
+ *
+ */
+static char *metrics_family(char *out, char const *name, char const *type, char const *help)
+{
+	return talloc_asprintf_append_buffer(out, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+/** Append the latency histograms of the workers
+ *
+ * @param[in] out	buffer to append to.
+ * @param[in] stats	of the threads, for the worker IDs.
+ * @param[in] sc	the scheduler.
+ * @param[in] name	of the metric family.
+ * @param[in] help	for the metric family.
+ * @param[in] shadow	whether to append the histograms of mirrored requests,
+ *			instead of production traffic.
+ * @return the buffer.
+ */
+static char *metrics_latency(char *out, fr_schedule_thread_stats_t *stats, fr_schedule_t *sc,
+			     char const *name, char const *help, bool shadow)
+{
+	int j, k;
+
+	out = metrics_family(out, name, "histogram", help);
+	for (j = 0; j < stats->num_workers; j++) {
+		for (k = 0; k < FR_WORKER_LATENCY_MAX; k++) {
+			fr_time_histogram_t	*h;
+			char			labels[64];
+
+			h = talloc_zero(stats, fr_time_histogram_t);
+			if (!h) break;
+
+			if (fr_schedule_latency_merge(sc, stats->worker_id[j], h, k, shadow) < 0) {
+				talloc_free(h);
+				break;	/* the worker has gone */
+			}
+
+			snprintf(labels, sizeof(labels), "worker=\"%d\",stage=\"%s\"", stats->worker_id[j], worker_stages[k]);
+			out = fr_metric_histogram_print(out, name, labels, h);
+			talloc_free(h);
+		}
+	}
+
+	return out;
+}
+
+/** Append the statistics of the network and worker threads
+ *
+ * @param[in] out	buffer to append to.
+ * @param[in] sc	the scheduler.
+ * @return the buffer.
+ */
+static char *metrics_threads(char *out, fr_schedule_t *sc)
+{
+	fr_schedule_thread_stats_t	*stats;
+	size_t				i;
+	int				j, k;
+
+	/*
+	 *	This waits for the threads to reply, but not for long.
+	 *	Threads which are stuck are left out.
+	 */
+	stats = fr_schedule_thread_stats(NULL, sc);
+	if (!stats) return out;
+
+	out = metrics_family(out, "freeradius_network_requests", "counter",
+			     "Requests sent to workers by the network thread.");
+	for (j = 0; j < stats->num_networks; j++) {
+		out = talloc_asprintf_append_buffer(out, "freeradius_network_requests_total{network=\"%d\"} %" PRIu64 "\n",
+						    stats->network_id[j], stats->network[j].num_requests);
+	}
+
+	out = metrics_family(out, "freeradius_network_replies", "counter",
+			     "Replies received from workers by the network thread.");
+	for (j = 0; j < stats->num_networks; j++) {
+		out = talloc_asprintf_append_buffer(out, "freeradius_network_replies_total{network=\"%d\"} %" PRIu64 "\n",
+						    stats->network_id[j], stats->network[j].num_replies);
+	}
+
+	out = metrics_family(out, "freeradius_network_dropped", "counter",
+			     "Packets dropped by the network thread, instead of being sent to a worker.");
+	for (j = 0; j < stats->num_networks; j++) {
+		for (k = 0; k < FR_NETWORK_DROP_MAX; k++) {
+			out = talloc_asprintf_append_buffer(out, "freeradius_network_dropped_total{network=\"%d\",reason=\"%s\"} %" PRIu64 "\n",
+							    stats->network_id[j], network_drops[k],
+							    stats->network[j].dropped[k]);
+		}
+	}
+
+	out = metrics_family(out, "freeradius_network_sockets", "gauge", "Sockets the network thread is reading from.");
+	for (j = 0; j < stats->num_networks; j++) {
+		out = talloc_asprintf_append_buffer(out, "freeradius_network_sockets{network=\"%d\"} %d\n",
+						    stats->network_id[j], stats->network[j].num_sockets);
+	}
+
+	for (i = 0; i < (sizeof(worker_fields) / sizeof(*worker_fields)); i++) {
+		metrics_worker_field_t const *field = &worker_fields[i];
+
+		out = metrics_family(out, field->name, field->counter ? "counter" : "gauge", field->help);
+		for (j = 0; j < stats->num_workers; j++) {
+			int const *value = (int const *) (((uint8_t const *) &stats->worker[j]) + field->offset);
+
+			out = talloc_asprintf_append_buffer(out, "%s%s{worker=\"%d\"} %d\n", field->name,
+							    field->counter ? "_total" : "",
+							    stats->worker_id[j], *value);
+		}
+	}
+
+	out = metrics_family(out, "freeradius_worker_running_seconds", "counter",
+			     "Time the worker spent running requests.");
+	for (j = 0; j < stats->num_workers; j++) {
+		out = talloc_asprintf_append_buffer(out, "freeradius_worker_running_seconds_total{worker=\"%d\"} %.9f\n",
+						    stats->worker_id[j], ((double) stats->worker[j].running) / NANOSEC);
+	}
+
+	/*
+	 *	Mirrored requests are also counted in the figures
+	 *	above, as they use the same workers.
+	 */
+	out = metrics_family(out, "freeradius_worker_mirrored_requests", "counter",
+			     "Mirrored requests processed by the worker.");
+	for (j = 0; j < stats->num_workers; j++) {
+		out = talloc_asprintf_append_buffer(out, "freeradius_worker_mirrored_requests_total{worker=\"%d\"} %d\n",
+						    stats->worker_id[j], stats->worker[j].num_shadow);
+	}
+
+	out = metrics_family(out, "freeradius_worker_mirrored_running_seconds", "counter",
+			     "Time the worker spent running mirrored requests.");
+	for (j = 0; j < stats->num_workers; j++) {
+		out = talloc_asprintf_append_buffer(out, "freeradius_worker_mirrored_running_seconds_total{worker=\"%d\"} %.9f\n",
+						    stats->worker_id[j], ((double) stats->worker[j].shadow_running) / NANOSEC);
+	}
+
+	/*
+	 *	The histograms are read while the workers are running.
+	 */
+	out = metrics_latency(out, stats, sc, "freeradius_worker_latency_seconds",
+			      "Time requests spent in each stage of processing.", false);
+	out = metrics_latency(out, stats, sc, "freeradius_worker_mirrored_latency_seconds",
+			      "Time mirrored requests spent in each stage of processing.", true);
+
+	talloc_free(stats);
+
+	return out;
+}
+
+/** Write all of a buffer to a socket
+ *
+ */
+static int metrics_send(int fd, char const *data, size_t len)
+{
+	ssize_t slen;
+
+	while (len > 0) {
+		slen = send(fd, data, len, MSG_NOSIGNAL);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		data += slen;
+		len -= slen;
+	}
+
+	return 0;
+}
+
+/** Accept a connection, and send the metrics
+ *
+ */
+static void metrics_accept(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, UNUSED void *ctx)
+{
+	int		client;
+	char		buffer[1024];
+	char		*body = NULL;
+	size_t		len;
+	struct timeval	tv = { METRICS_TIMEOUT, 0 };
+
+	client = accept(fd, NULL, NULL);
+	if (client < 0) return;
+
+	/*
+	 *	Some platforms have accepted sockets inherit O_NONBLOCK
+	 *	from the listener.  We want to block, but not for long,
+	 *	so a slow client doesn't hold up the event loop.
+	 */
+	if (fr_blocking(client) < 0) goto done;
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/*
+	 *	We only have one thing to serve, so we don't care
+	 *	what was asked for.  But we read the request, so the
+	 *	client doesn't see a reset when we close.
+	 */
+	if (recv(client, buffer, sizeof(buffer), 0) < 0) goto done;
+
+	body = talloc_strdup(NULL, "");
+	if (!body) goto done;
+
+	body = fr_metric_print(body);
+	if (main_config.scheduler) body = metrics_threads(body, main_config.scheduler);
+	body = talloc_strdup_append_buffer(body, "# EOF\n");
+	if (!body) goto done;
+
+	len = snprintf(buffer, sizeof(buffer),
+		       "HTTP/1.0 200 OK\r\n"
+		       "Content-Type: %s\r\n"
+		       "Content-Length: %zu\r\n"
+		       "Connection: close\r\n"
+		       "\r\n", metrics_type, strlen(body));
+
+	if (metrics_send(client, buffer, len) < 0) goto done;
+	metrics_send(client, body, strlen(body));
+
+done:
+	talloc_free(body);
+	close(client);
+}
+
+/** Open the metrics listener, if one was configured
+ *
+ * @param[in] el	to insert the listener into.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int metrics_open(fr_event_list_t *el)
+{
+	fr_ipaddr_t	ipaddr;
+	uint16_t	port;
+	char const	*listen_str = main_config.metrics_listen;
+
+	if (!listen_str || (metrics_sockfd >= 0)) return 0;
+
+	/*
+	 *	Just a port, listen on all addresses.
+	 */
+	if (!strchr(listen_str, ':')) {
+		unsigned long num;
+		char *end;
+
+		num = strtoul(listen_str, &end, 10);
+		if (*end || !num || (num > UINT16_MAX)) {
+			ERROR("Invalid metrics listen port \"%s\"", listen_str);
+			return -1;
+		}
+		port = num;
+
+		memset(&ipaddr, 0, sizeof(ipaddr));
+		ipaddr.af = AF_INET;
+		ipaddr.prefix = 32;
+	} else if (fr_inet_pton_port(&ipaddr, &port, listen_str, -1, AF_UNSPEC, true, true) < 0) {
+		ERROR("Invalid metrics listen address \"%s\": %s", listen_str, fr_strerror());
+		return -1;
+	}
+
+	metrics_sockfd = fr_socket_server_tcp(&ipaddr, &port, NULL, true);
+	if (metrics_sockfd < 0) {
+		ERROR("Failed opening metrics socket: %s", fr_strerror());
+		return -1;
+	}
+
+	if (fr_socket_bind(metrics_sockfd, &ipaddr, &port, NULL) < 0) {
+		ERROR("Failed binding metrics socket: %s", fr_strerror());
+	error:
+		close(metrics_sockfd);
+		metrics_sockfd = -1;
+		return -1;
+	}
+
+	if (listen(metrics_sockfd, 8) < 0) {
+		ERROR("Failed listening on metrics socket: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if (fr_event_fd_insert(el, el, metrics_sockfd, metrics_accept, NULL, NULL, NULL) < 0) {
+		ERROR("Failed inserting metrics socket: %s", fr_strerror());
+		goto error;
+	}
+
+	INFO("Serving metrics on port %u", port);
+
+	return 0;
+}
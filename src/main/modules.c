@@ -32,11 +32,49 @@ RCSID("$Id$")
 #include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/interpreter.h>
 #include <freeradius-devel/parser.h>
+#include <freeradius-devel/io/metrics.h>
+#include <freeradius-devel/io/memory.h>
+#include <freeradius-devel/startup_trace.h>
 
-fr_thread_local_setup(rbtree_t *, module_thread_inst_tree)
+fr_thread_local_setup(module_thread_instance_t **, module_thread_inst_array)
+
+#define MODULE_MEMORY_INTERVAL	(5)	//!< Seconds between measurements of the thread instance data.
+
+static _Thread_local fr_event_timer_t const *module_memory_ev;	//!< Measures this thread's instance data.
 
 static TALLOC_CTX *instance_ctx = NULL;
 
+static uint32_t module_instance_num = 0;	//!< Number of module instances, and the size of
+						//!< each thread's array of thread instances.
+
+/*
+ *	Modules are instantiated by several threads at startup.  Only one
+ *	thread runs module code at a time, as instantiate functions register
+ *	xlats, and change the configuration.  The lock is released while
+ *	connection pools open their initial connections, which is where
+ *	most of the time goes.
+ *
+ *	Modules depend on each other by referencing a sibling's
+ *	configuration.  The sibling is instantiated first, or waited for if
+ *	another thread is instantiating it.
+ */
+typedef struct {
+	module_instance_t	*waiting_for;	//!< Module being instantiated by another thread.
+} module_instantiate_thread_t;
+
+typedef struct {
+	module_instance_t	**mod_inst;	//!< Every module, in the order they're configured.
+	uint32_t		num;
+	uint32_t		next;		//!< The next module to instantiate.
+	bool			failed;
+} module_instantiate_queue_t;
+
+static bool		instantiate_parallel = false;	//!< Whether instantiate_mutex is used.
+static pthread_mutex_t	instantiate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	instantiate_cond = PTHREAD_COND_INITIALIZER;	//!< Signalled when a module is done.
+
+fr_thread_local_setup(module_instantiate_thread_t *, instantiate_thread)
+
 /*
  *	Ordered by component
  */
@@ -57,6 +95,16 @@ const section_type_value_t section_type_value[MOD_COUNT] = {
 
 static int module_instantiate(CONF_SECTION *root, char const *name);
 
+static inline void module_instantiate_lock(void)
+{
+	if (instantiate_parallel) pthread_mutex_lock(&instantiate_mutex);
+}
+
+static inline void module_instantiate_unlock(void)
+{
+	if (instantiate_parallel) pthread_mutex_unlock(&instantiate_mutex);
+}
+
 static bool is_reserved_word(const char *name)
 {
 	int i;
@@ -322,14 +370,31 @@ fr_pool_t *module_connection_pool_init(CONF_SECTION *module,
 	 */
 	pool = cf_data_value(cf_data_find(cs, fr_pool_t, NULL));
 	if (!pool) {
+		CONF_DATA const *cd;
+
 		DEBUG4("%s: No pool reference found for config item \"%s.pool\"", log_prefix, parent_name(cs));
-		pool = fr_pool_init(cs, cs, opaque, c, a, log_prefix);
+		pool = fr_pool_alloc(cs, cs, opaque, c, a, log_prefix);
 		if (!pool) return NULL;
 
 		fr_pool_enable_triggers(pool, trigger_prefix, trigger_args);
 
 		DEBUG4("%s: Adding pool reference %p to config item \"%s.pool\"", log_prefix, pool, parent_name(cs));
-		cf_data_add(cs, pool, NULL, false);
+		cd = cf_data_add(cs, pool, NULL, false);
+
+		/*
+		 *	Opening the connections only uses the pool, so
+		 *	other modules can be instantiated meanwhile.
+		 */
+		module_instantiate_unlock();
+		ret = fr_pool_start(pool);
+		module_instantiate_lock();
+
+		if (ret < 0) {
+			cf_data_remove(cs, cd);
+			fr_pool_free(pool);
+			return NULL;
+		}
+
 		return pool;
 	}
 	fr_pool_ref(pool);
@@ -412,6 +477,7 @@ int modules_free(void)
 	 *	Free instances first, then dynamic libraries.
 	 */
 	TALLOC_FREE(instance_ctx);
+	module_instance_num = 0;
 
 	return 0;
 }
@@ -480,6 +546,9 @@ module_instance_t *module_find_with_method(rlm_components_t *method, CONF_SECTIO
 }
 
 /** Retrieve module/thread specific instance data for a module
+ *
+ * This is called for every module call, so it's a single load from the
+ * thread's array of thread instances.
  *
  * @param[in] instance	to find thread specific data for.
  * @return
@@ -488,16 +557,39 @@ module_instance_t *module_find_with_method(rlm_components_t *method, CONF_SECTIO
  */
 void *module_thread_instance_find(void *instance)
 {
-	module_instance_t		*mod_inst = talloc_get_type_abort(instance, module_instance_t);
-	rbtree_t			*tree = module_thread_inst_tree;
-	module_thread_instance_t	find;
+	module_instance_t		*mod_inst = instance;
+	module_thread_instance_t	**array = module_thread_inst_array;
 
-	memset(&find, 0, sizeof(find));
-	find.inst = mod_inst;
+	rad_assert(array && (mod_inst->number < talloc_array_length(array)));
 
-	return rbtree_finddata(tree, &find);
+	return array[mod_inst->number];
 }
 
+#define MODULE_RESULT(_rcode) { "freeradius_module_results", "rcode=\"" _rcode "\"", FR_METRIC_COUNTER, \
+			       "Calls to the module which finished, by return code." }
+
+static fr_metric_t const module_metrics[MODULE_METRIC_MAX] = {
+	[MODULE_METRIC_CALLS] = { "freeradius_module_calls", NULL, FR_METRIC_COUNTER,
+				  "Calls to the module." },
+	[MODULE_METRIC_ACTIVE] = { "freeradius_module_active", NULL, FR_METRIC_GAUGE,
+				   "Calls to the module which are waiting for something." },
+	[MODULE_METRIC_LATENCY] = { "freeradius_module_latency_seconds", NULL, FR_METRIC_HISTOGRAM,
+				    "Time from calling the module, to its result." },
+	[MODULE_METRIC_RUN_TIME] = { "freeradius_module_run_nanoseconds", NULL, FR_METRIC_COUNTER,
+				     "Time spent running the module." },
+	[MODULE_METRIC_YIELD_TIME] = { "freeradius_module_yielded_nanoseconds", NULL, FR_METRIC_COUNTER,
+				       "Time calls to the module spent waiting for something." },
+	[MODULE_METRIC_RCODE + RLM_MODULE_REJECT]	= MODULE_RESULT("reject"),
+	[MODULE_METRIC_RCODE + RLM_MODULE_FAIL]		= MODULE_RESULT("fail"),
+	[MODULE_METRIC_RCODE + RLM_MODULE_OK]		= MODULE_RESULT("ok"),
+	[MODULE_METRIC_RCODE + RLM_MODULE_HANDLED]	= MODULE_RESULT("handled"),
+	[MODULE_METRIC_RCODE + RLM_MODULE_INVALID]	= MODULE_RESULT("invalid"),
+	[MODULE_METRIC_RCODE + RLM_MODULE_USERLOCK]	= MODULE_RESULT("userlock"),
+	[MODULE_METRIC_RCODE + RLM_MODULE_NOTFOUND]	= MODULE_RESULT("notfound"),
+	[MODULE_METRIC_RCODE + RLM_MODULE_NOOP]		= MODULE_RESULT("noop"),
+	[MODULE_METRIC_RCODE + RLM_MODULE_UPDATED]	= MODULE_RESULT("updated"),
+};
+
 /** Destructor for module_thread_instance_t
  *
  * @note This cannot be converted to a talloc destructor,
@@ -512,38 +604,32 @@ static void _module_thread_instance_free(void *to_free)
 		(void) thread_inst->inst->module->thread_detach(thread_inst->data);
 	}
 
+	if (thread_inst->inst->memory) fr_memory_add(thread_inst->inst->memory, -(int64_t) thread_inst->memory_used);
+
 	talloc_free(thread_inst);
 }
 
-/** Frees the thread local instance free and any thread local instance data
+/** Frees the thread local instance array and any thread local instance data
  *
- * @param[in] to_free	Thread specific module instance tree to free.
- */
-static void _module_thread_inst_tree_free(void *to_free)
-{
-	rbtree_t *thread_inst_tree = talloc_get_type_abort(to_free , rbtree_t);
-
-	talloc_free(thread_inst_tree);
-}
-
-/** Compare two thread instances based on inst pointer
+ * Thread instances are freed in the reverse order to the one the
+ * modules were loaded in.
  *
- * @param[in] a		First thread specific module instance.
- * @param[in] b		Second thread specific module instance.
- * @return
- *	- +1 if a > b.
- *	- -1 if a < b.
- *	- 0 if a == b.
+ * @param[in] to_free	Thread specific module instance array to free.
  */
-static int _module_thread_inst_tree_cmp(void const *a, void const *b)
+static void _module_thread_inst_array_free(void *to_free)
 {
-	module_thread_instance_t const *my_a = a, *my_b = b;
+	module_thread_instance_t	**array = talloc_get_type_abort(to_free, module_thread_instance_t *);
+	size_t				i;
 
-	return (my_a->inst > my_b->inst) - (my_a->inst < my_b->inst);
+	for (i = talloc_array_length(array); i > 0; i--) {
+		if (array[i - 1]) _module_thread_instance_free(array[i - 1]);
+	}
+
+	talloc_free(array);
 }
 
 typedef struct {
-	rbtree_t	*tree;		//!< Containing the thread instances.
+	module_thread_instance_t **array;	//!< Containing the thread instances.
 	fr_event_list_t *el;		//!< Event list for this thread.
 } _thread_intantiate_ctx_t;
 
@@ -562,9 +648,25 @@ static int _module_thread_instantiate(void *instance, void *ctx)
 	_thread_intantiate_ctx_t	*thread_inst_ctx = ctx;
 	int				ret;
 
+	rad_assert(mod_inst->number < talloc_array_length(thread_inst_ctx->array));
+
+	/*
+	 *	Already done for this thread.
+	 */
+	if (thread_inst_ctx->array[mod_inst->number]) return 0;
+
 	MEM(thread_inst = talloc_zero(NULL, module_thread_instance_t));
 	thread_inst->inst = mod_inst;
 
+	/*
+	 *	The module works without metrics, so failing to
+	 *	allocate them isn't fatal.
+	 */
+	thread_inst->metrics = fr_metric_set_alloc(thread_inst, module_metrics, MODULE_METRIC_MAX, false);
+	if (thread_inst->metrics && (fr_metric_set_label(thread_inst->metrics, "module", mod_inst->name) < 0)) {
+		TALLOC_FREE(thread_inst->metrics);
+	}
+
 	if (mod_inst->module->thread_inst_size) {
 		char *type_name;
 
@@ -581,8 +683,12 @@ static int _module_thread_instantiate(void *instance, void *ctx)
 	}
 
 	if (mod_inst->module->thread_instantiate) {
+		fr_startup_phase_t *trace;
+
+		trace = fr_startup_trace_start("module.thread_instantiate", "%s", mod_inst->name);
 		ret = mod_inst->module->thread_instantiate(mod_inst->dl_inst->conf, mod_inst->dl_inst->data,
 							   thread_inst_ctx->el, thread_inst->data);
+		fr_startup_trace_stop(trace);
 		if (ret < 0) {
 			ERROR("Thread instantiation failed for module \"%s\"",
 			      mod_inst->name);
@@ -590,11 +696,45 @@ static int _module_thread_instantiate(void *instance, void *ctx)
 		}
 	}
 
-	rbtree_insert(thread_inst_ctx->tree, thread_inst);
+	if (thread_inst->data && mod_inst->memory) {
+		fr_memory_update(mod_inst->memory, &thread_inst->memory_used, talloc_total_size(thread_inst->data));
+	}
+
+	thread_inst_ctx->array[mod_inst->number] = thread_inst;
 
 	return 0;
 }
 
+/** Measure the thread instance data of this thread's modules, and check again later
+ *
+ * Only the thread which owns the data can walk it, so each thread
+ * measures its own.
+ */
+static void _modules_thread_memory(fr_event_list_t *el, struct timeval *now, UNUSED void *uctx)
+{
+	module_thread_instance_t	**array = module_thread_inst_array;
+	struct timeval			when;
+	size_t				i;
+
+	if (!array) return;
+
+	for (i = 0; i < talloc_array_length(array); i++) {
+		module_thread_instance_t *thread_inst = array[i];
+
+		if (!thread_inst || !thread_inst->data || !thread_inst->inst->memory) continue;
+
+		fr_memory_update(thread_inst->inst->memory, &thread_inst->memory_used,
+				 talloc_total_size(thread_inst->data));
+	}
+
+	when = *now;
+	when.tv_sec += MODULE_MEMORY_INTERVAL;
+
+	if (fr_event_timer_insert(NULL, el, &module_memory_ev, &when, _modules_thread_memory, NULL) < 0) {
+		PERROR("Failed inserting event to measure module memory");
+	}
+}
+
 /** Creates per-thread instance data for modules which need it
  *
  * Must be called by any new threads before attempting to execute unlang sections.
@@ -608,32 +748,151 @@ static int _module_thread_instantiate(void *instance, void *ctx)
 int modules_thread_instantiate(CONF_SECTION *root, fr_event_list_t *el)
 {
 	CONF_SECTION			*modules;
-	rbtree_t			*thread_inst_tree;
+	module_thread_instance_t	**array;
 	_thread_intantiate_ctx_t	ctx;
+	fr_startup_phase_t		*trace;
+	int				ret = 0;
 
 	modules = cf_section_find(root, "modules", NULL);
 	if (!modules) return 0;
 
-	thread_inst_tree = module_thread_inst_tree;
-	if (!thread_inst_tree) {
-		MEM(thread_inst_tree = rbtree_create(NULL, _module_thread_inst_tree_cmp,
-						     _module_thread_instance_free, 0));
-		fr_thread_local_set_destructor(module_thread_inst_tree,
-					       _module_thread_inst_tree_free, thread_inst_tree);
+	array = module_thread_inst_array;
+	if (!array) {
+		MEM(array = talloc_zero_array(NULL, module_thread_instance_t *, module_instance_num));
+		fr_thread_local_set_destructor(module_thread_inst_array,
+					       _module_thread_inst_array_free, array);
 	}
 
 	ctx.el = el;
-	ctx.tree = thread_inst_tree;
+	ctx.array = array;
 
+	trace = fr_startup_trace_start("thread.instantiate", NULL);
 	if (cf_data_walk(modules, module_instance_t, _module_thread_instantiate, &ctx) < 0) {
-		_module_thread_inst_tree_free(thread_inst_tree);	/* make re-entrant */
-		module_thread_inst_tree = NULL;
+		_module_thread_inst_array_free(array);	/* make re-entrant */
+		module_thread_inst_array = NULL;
+		ret = -1;
+	}
+	fr_startup_trace_stop(trace);
+
+	if ((ret == 0) && !module_memory_ev) {
+		struct timeval when;
+
+		gettimeofday(&when, NULL);
+		when.tv_sec += MODULE_MEMORY_INTERVAL;
+
+		if (fr_event_timer_insert(NULL, el, &module_memory_ev, &when, _modules_thread_memory, NULL) < 0) {
+			PERROR("Failed inserting event to measure module memory");
+		}
+	}
+
+	return ret;
+}
+
+/** Wait for another thread to finish instantiating a module
+ *
+ * @param[in] mod_inst	being instantiated.
+ * @return
+ *	- 0 if the module was instantiated.
+ *	- -1 if it failed, or if waiting would deadlock.
+ */
+static int module_instantiate_wait(module_instance_t *mod_inst)
+{
+	module_instantiate_thread_t *self = instantiate_thread;
+	module_instantiate_thread_t *t;
+
+	/*
+	 *	Either we're instantiating it, or the thread which
+	 *	is, is waiting for us.
+	 */
+	for (t = mod_inst->instantiated_by; t; t = t->waiting_for ? t->waiting_for->instantiated_by : NULL) {
+		if (t == self) break;
+	}
+
+	if (!instantiate_parallel || !self || t) {
+		cf_log_err(mod_inst->dl_inst->conf, "Module reference loop found instantiating \"%s\"",
+			   mod_inst->name);
+		return -1;
+	}
+
+	self->waiting_for = mod_inst;
+	while (mod_inst->instantiating) pthread_cond_wait(&instantiate_cond, &instantiate_mutex);
+	self->waiting_for = NULL;
+
+	if (!mod_inst->instantiated) {
+		cf_log_err(mod_inst->dl_inst->conf, "Module \"%s\" failed to instantiate", mod_inst->name);
 		return -1;
 	}
 
 	return 0;
 }
 
+typedef struct {
+	size_t		soft_limit;
+	size_t		hard_limit;
+} module_memory_limits_t;
+
+static const CONF_PARSER module_memory_config[] = {
+	{ FR_CONF_OFFSET("soft_limit", FR_TYPE_SIZE, module_memory_limits_t, soft_limit), .dflt = "0" },
+	{ FR_CONF_OFFSET("hard_limit", FR_TYPE_SIZE, module_memory_limits_t, hard_limit), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+/** Create the memory set of a module, with the limits from its "memory" subsection
+ *
+ * @param[in] mod_inst	to create the set for.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int module_memory_init(module_instance_t *mod_inst)
+{
+	CONF_SECTION		*cs;
+	module_memory_limits_t	limits = { 0 };
+
+	if (mod_inst->memory) return 0;
+
+	cs = cf_section_find(mod_inst->dl_inst->conf, "memory", NULL);
+	if (cs) {
+		if ((cf_section_rules_push(cs, module_memory_config) < 0) ||
+		    (cf_section_parse(NULL, &limits, cs) < 0)) return -1;
+
+		if (limits.soft_limit && limits.hard_limit && (limits.soft_limit > limits.hard_limit)) {
+			cf_log_err(cs, "'soft_limit' must not be larger than 'hard_limit'");
+			return -1;
+		}
+	}
+
+	MEM(mod_inst->memory = fr_memory_alloc(mod_inst, "module", mod_inst->name));
+	fr_memory_limits(mod_inst->memory, limits.soft_limit, limits.hard_limit);
+
+	return 0;
+}
+
+/** Return the memory set of a module
+ *
+ * Modules which keep things in memory at run time, e.g. caches, count
+ * them in this set, and check its limits.  Which is why the set is
+ * created before the module's instantiate function is called.
+ *
+ * @param[in] module	configuration of the module.
+ * @return
+ *	- The module's memory set.
+ *	- NULL if the module hasn't been instantiated.
+ */
+fr_memory_t *module_memory(CONF_SECTION *module)
+{
+	module_instance_t	*mod_inst;
+	char const		*name;
+
+	name = cf_section_name2(module);
+	if (!name) name = cf_section_name1(module);
+
+	mod_inst = cf_data_value(cf_data_find(cf_item_to_section(cf_parent(module)), module_instance_t, name));
+	if (!mod_inst) return NULL;
+
+	return mod_inst->memory;
+}
+
 /** Complete module setup by calling its instantiate function
  *
  * @param[in] instance	of module to complete instantiation for.
@@ -644,16 +903,28 @@ int modules_thread_instantiate(CONF_SECTION *root, fr_event_list_t *el)
  */
 static int _module_instantiate(void *instance, UNUSED void *ctx)
 {
-	module_instance_t *mod_inst = talloc_get_type_abort(instance, module_instance_t);
+	module_instance_t	*mod_inst = talloc_get_type_abort(instance, module_instance_t);
+	struct timeval		start, end, elapsed;
+	fr_startup_phase_t	*trace;
+	int			ret = -1;
 
 	if (mod_inst->instantiated) return 0;
 
+	if (mod_inst->instantiating) return module_instantiate_wait(mod_inst);
+
+	mod_inst->instantiating = true;
+	mod_inst->instantiated_by = instantiate_thread;
+	trace = fr_startup_trace_start("module.instantiate", "%s", mod_inst->name);
+	gettimeofday(&start, NULL);
+
 	/*
 	 *	Now that ALL modules are instantiated, and ALL xlats
 	 *	are defined, go compile the config items marked as XLAT.
 	 */
 	if (mod_inst->module->config && (cf_section_parse_pass2(mod_inst->dl_inst->data,
-								mod_inst->dl_inst->conf) < 0)) return -1;
+								mod_inst->dl_inst->conf) < 0)) goto done;
+
+	if (module_memory_init(mod_inst) < 0) goto done;
 
 	/*
 	 *	Call the instantiate method, if any.
@@ -668,7 +939,7 @@ static int _module_instantiate(void *instance, UNUSED void *ctx)
 			cf_log_err(mod_inst->dl_inst->conf, "Instantiation failed for module \"%s\"",
 				   mod_inst->name);
 
-			return -1;
+			goto done;
 		}
 	}
 
@@ -686,13 +957,52 @@ static int _module_instantiate(void *instance, UNUSED void *ctx)
 		pthread_mutex_init(mod_inst->mutex, NULL);
 	}
 
+	/*
+	 *	Modules which can be reloaded have generations of
+	 *	instance data.  Modules which register things in
+	 *	bootstrap, or have per-thread data, would need those
+	 *	redone too, so they can't be reloaded.
+	 */
+	if (((mod_inst->module->type & RLM_TYPE_HUP_SAFE) != 0) &&
+	    !mod_inst->module->bootstrap && !mod_inst->module->thread_instantiate &&
+	    !mod_inst->module->thread_inst_size) {
+		mod_inst->hup_mutex = talloc_zero(mod_inst, pthread_mutex_t);
+		pthread_mutex_init(mod_inst->hup_mutex, NULL);
+
+		MEM(mod_inst->generation = talloc_zero(NULL, module_generation_t));
+		mod_inst->generation->mod_inst = mod_inst;
+		mod_inst->generation->dl_inst = mod_inst->dl_inst;
+	}
+
+	/*
+	 *	The instance data doesn't change after this, so it's
+	 *	only measured once.  A generation uncounts its data
+	 *	when it's freed.
+	 */
+	if (mod_inst->dl_inst->data) {
+		fr_memory_update(mod_inst->memory, &mod_inst->memory_used, talloc_total_size(mod_inst->dl_inst->data));
+		if (mod_inst->generation) mod_inst->generation->memory_used = mod_inst->memory_used;
+	}
+
 #ifndef NDEBUG
 	if (mod_inst->dl_inst->data) module_instance_read_only(mod_inst->dl_inst->data, mod_inst->name);
 #endif
 
 	mod_inst->instantiated = true;
+	ret = 0;
 
-	return 0;
+	gettimeofday(&end, NULL);
+	fr_timeval_subtract(&elapsed, &end, &start);
+	cf_log_debug(mod_inst->dl_inst->conf, "Instantiated module \"%s\" in %u.%06u seconds", mod_inst->name,
+		     (unsigned int) elapsed.tv_sec, (unsigned int) elapsed.tv_usec);
+
+done:
+	fr_startup_trace_stop(trace);
+	mod_inst->instantiating = false;
+	mod_inst->instantiated_by = NULL;
+	if (instantiate_parallel) pthread_cond_broadcast(&instantiate_cond);
+
+	return ret;
 }
 
 /** Force instantiation of a module
@@ -725,6 +1035,46 @@ static int module_instantiate(CONF_SECTION *root, char const *name)
 	return _module_instantiate(mod_inst, NULL);
 }
 
+static int _module_instantiate_enqueue(void *instance, void *ctx)
+{
+	module_instantiate_queue_t *queue = ctx;
+
+	queue->mod_inst = talloc_realloc(NULL, queue->mod_inst, module_instance_t *, queue->num + 1);
+	if (!queue->mod_inst) return -1;
+
+	queue->mod_inst[queue->num++] = talloc_get_type_abort(instance, module_instance_t);
+
+	return 0;
+}
+
+/** Instantiate modules from the queue, until it's empty
+ *
+ */
+static void *module_instantiate_worker(void *arg)
+{
+	module_instantiate_queue_t	*queue = arg;
+	module_instantiate_thread_t	thread = { .waiting_for = NULL };
+
+	instantiate_thread = &thread;
+
+	module_instantiate_lock();
+	while (!queue->failed && (queue->next < queue->num)) {
+		module_instance_t *mod_inst = queue->mod_inst[queue->next++];
+
+		/*
+		 *	Already done, or another thread is doing it.
+		 */
+		if (mod_inst->instantiated || mod_inst->instantiating) continue;
+
+		if (_module_instantiate(mod_inst, NULL) < 0) queue->failed = true;
+	}
+	module_instantiate_unlock();
+
+	instantiate_thread = NULL;
+
+	return NULL;
+}
+
 /** Completes instantiation of modules
  *
  * Allows the module to initialise connection pools, and complete any registrations that depend on
@@ -737,14 +1087,91 @@ static int module_instantiate(CONF_SECTION *root, char const *name)
  */
 int modules_instantiate(CONF_SECTION *root)
 {
-	CONF_SECTION *modules;
+	CONF_SECTION			*modules;
+	module_instantiate_queue_t	queue;
+	module_instantiate_thread_t	thread = { .waiting_for = NULL };
+	pthread_t			*threads;
+	uint32_t			i, num_threads;
+	struct timeval			start, end, elapsed;
 
 	modules = cf_section_find(root, "modules", NULL);
 	if (!modules) return 0;
 
 	DEBUG2("%s: #### Instantiating modules ####", main_config.name);
 
-	if (cf_data_walk(modules, module_instance_t, _module_instantiate, NULL) < 0) return -1;
+	gettimeofday(&start, NULL);
+
+	memset(&queue, 0, sizeof(queue));
+	if (cf_data_walk(modules, module_instance_t, _module_instantiate_enqueue, &queue) < 0) {
+		talloc_free(queue.mod_inst);
+		return -1;
+	}
+
+	/*
+	 *	Modules which have to be instantiated by the main
+	 *	thread go first, along with anything they reference.
+	 */
+	instantiate_thread = &thread;
+	for (i = 0; i < queue.num; i++) {
+		if (!(queue.mod_inst[i]->module->type & RLM_TYPE_INSTANTIATE_MAIN)) continue;
+
+		if (_module_instantiate(queue.mod_inst[i], NULL) < 0) {
+			instantiate_thread = NULL;
+			talloc_free(queue.mod_inst);
+			return -1;
+		}
+	}
+	instantiate_thread = NULL;
+
+	/*
+	 *	No connections are opened when checking the
+	 *	configuration, so there's nothing to wait for.
+	 */
+	num_threads = main_config.num_instantiate;
+	if (num_threads > queue.num) num_threads = queue.num;
+	if (check_config) num_threads = 1;
+
+	/*
+	 *	The time and memory used by each module can only be
+	 *	told apart if they're instantiated one at a time.
+	 */
+	if (fr_startup_trace_enabled()) num_threads = 1;
+
+	if (num_threads <= 1) {
+		(void) module_instantiate_worker(&queue);
+	} else {
+		MEM(threads = talloc_array(NULL, pthread_t, num_threads));
+
+		instantiate_parallel = true;
+		for (i = 0; i < num_threads; i++) {
+			int rcode;
+
+			rcode = pthread_create(&threads[i], NULL, module_instantiate_worker, &queue);
+			if (rcode != 0) {
+				ERROR("Failed creating thread to instantiate modules: %s", fr_syserror(rcode));
+				break;
+			}
+		}
+		num_threads = i;
+
+		/*
+		 *	If we couldn't start any threads, do it ourselves.
+		 */
+		if (!num_threads) (void) module_instantiate_worker(&queue);
+
+		for (i = 0; i < num_threads; i++) (void) pthread_join(threads[i], NULL);
+		instantiate_parallel = false;
+
+		talloc_free(threads);
+	}
+
+	talloc_free(queue.mod_inst);
+	if (queue.failed) return -1;
+
+	gettimeofday(&end, NULL);
+	fr_timeval_subtract(&elapsed, &end, &start);
+	DEBUG2("%s: Instantiated %u modules in %u.%06u seconds", main_config.name, queue.num,
+	       (unsigned int) elapsed.tv_sec, (unsigned int) elapsed.tv_usec);
 
 #ifndef NDEBUG
 	{
@@ -763,6 +1190,384 @@ int modules_instantiate(CONF_SECTION *root)
 	return 0;
 }
 
+/** Get the instance data a request should call a module with
+ *
+ * If the module can be reloaded, the current generation is referenced,
+ * so it isn't freed while the request is using it.
+ *
+ * @param[out] generation	to pass to module_instance_release() when the
+ *				request is done with the module.  NULL if the
+ *				module can't be reloaded.
+ * @param[in] mod_inst		to get the instance data of.
+ * @return the instance data.
+ */
+void *module_instance_acquire(module_generation_t **generation, module_instance_t *mod_inst)
+{
+	module_generation_t *gen;
+
+	if (!mod_inst->hup_mutex) {
+		*generation = NULL;
+		return mod_inst->dl_inst->data;
+	}
+
+	pthread_mutex_lock(mod_inst->hup_mutex);
+	gen = mod_inst->generation;
+	gen->refs++;
+	pthread_mutex_unlock(mod_inst->hup_mutex);
+
+	*generation = gen;
+
+	return gen->dl_inst->data;
+}
+
+/** Release a reference to a generation of a module's instance data
+ *
+ * Old generations are freed by the main thread, once they have no references.
+ *
+ * @param[in] generation	from module_instance_acquire().
+ */
+void module_instance_release(module_generation_t *generation)
+{
+	module_instance_t *mod_inst = generation->mod_inst;
+
+	pthread_mutex_lock(mod_inst->hup_mutex);
+	rad_assert(generation->refs > 0);
+	generation->refs--;
+	pthread_mutex_unlock(mod_inst->hup_mutex);
+}
+
+/** Free a generation, and its instance data
+ *
+ * The first generation's instance data belongs to the module instance,
+ * later ones to the generation.
+ */
+static void module_generation_free(module_generation_t *gen)
+{
+	fr_memory_add(gen->mod_inst->memory, -(int64_t) gen->memory_used);
+
+	/*
+	 *	Runs the module's detach method before any
+	 *	configuration owned by the generation is freed.
+	 */
+	talloc_free(gen->dl_inst);
+	talloc_free(gen);
+}
+
+/** Free any old generations of a module which are no longer used
+ *
+ * @param[in] instance	of the module.
+ * @param[in] ctx	set to true if there are generations still in use.
+ * @return 0.
+ */
+static int _module_generation_reap(void *instance, void *ctx)
+{
+	module_instance_t	*mod_inst = talloc_get_type_abort(instance, module_instance_t);
+	bool			*in_use = ctx;
+	module_generation_t	**last, *gen, *unused = NULL;
+
+	if (!mod_inst->retired) return 0;
+
+	pthread_mutex_lock(mod_inst->hup_mutex);
+	last = &mod_inst->retired;
+	while ((gen = *last)) {
+		if (gen->refs > 0) {
+			last = &gen->next;
+			continue;
+		}
+
+		*last = gen->next;
+		gen->next = unused;
+		unused = gen;
+	}
+	if (mod_inst->retired) *in_use = true;
+	pthread_mutex_unlock(mod_inst->hup_mutex);
+
+	while ((gen = unused)) {
+		unused = gen->next;
+
+		DEBUG2("Freeing old instance of module \"%s\"", mod_inst->name);
+		module_generation_free(gen);
+	}
+
+	return 0;
+}
+
+static fr_event_timer_t const *reap_ev = NULL;
+
+/** Free old generations of modules, and check again later if some are still in use
+ *
+ */
+static void _modules_reap(fr_event_list_t *el, struct timeval *now, UNUSED void *uctx)
+{
+	CONF_SECTION	*modules;
+	bool		in_use = false;
+	struct timeval	when;
+
+	modules = cf_section_find(main_config.config, "modules", NULL);
+	if (!modules) return;
+
+	(void) cf_data_walk(modules, module_instance_t, _module_generation_reap, &in_use);
+	if (!in_use) return;
+
+	when = *now;
+	when.tv_sec++;
+
+	if (fr_event_timer_insert(NULL, el, &reap_ev, &when, _modules_reap, NULL) < 0) {
+		PERROR("Failed inserting event to free old module instances");
+	}
+}
+
+/** Reload a module
+ *
+ * A new generation of instance data is created, and requests which call
+ * the module from now on use it.  Requests which are already using the
+ * module carry on with the old generation, which is freed when they're done.
+ *
+ * If the new generation can't be created, the module carries on with the
+ * old one.
+ *
+ * @param[in] mod_inst	to reload.
+ * @param[in] cs	the module's new configuration.  NULL to re-read the
+ *			module's files with its current configuration.
+ * @param[in] el	of the main thread, where old generations are freed.
+ * @param[in] when	the server was HUPed.
+ * @return
+ *	- 1 if the module was reloaded.
+ *	- 0 if the module can't be reloaded, or was reloaded recently.
+ *	- -1 on failure.
+ */
+int module_hup_module(module_instance_t *mod_inst, CONF_SECTION *cs, fr_event_list_t *el, time_t when)
+{
+	module_generation_t	*gen, *old;
+	struct timeval		now;
+
+	if (!mod_inst->generation) return 0;
+
+	/*
+	 *	Silently ignore multiple HUPs within a short time period.
+	 */
+	if ((mod_inst->last_hup + 2) >= when) return 0;
+	mod_inst->last_hup = when;
+	mod_inst->hup_pending = false;
+
+	MEM(gen = talloc_zero(NULL, module_generation_t));
+	gen->mod_inst = mod_inst;
+
+	/*
+	 *	The copy belongs to the generation, and is freed
+	 *	along with it.
+	 */
+	if (!cs) {
+		CONF_SECTION *old_cs = mod_inst->dl_inst->conf;
+
+		cs = cf_section_dup(cf_item_to_section(cf_parent(old_cs)), old_cs,
+				    cf_section_name1(old_cs), cf_section_name2(old_cs), true);
+		if (!cs) {
+			talloc_free(gen);
+			return -1;
+		}
+		talloc_steal(gen, cs);
+	}
+
+	cf_log_info(cs, "Reloading module \"%s\"", mod_inst->name);
+
+	if (dl_instance(gen, &gen->dl_inst, cs, NULL, cf_section_name1(cs), DL_TYPE_MODULE) < 0) {
+	error:
+		cf_log_err(cs, "Failed reloading module \"%s\".  Using old configuration", mod_inst->name);
+		talloc_free(gen);
+		return -1;
+	}
+
+	/*
+	 *	The module must still be the same one.
+	 */
+	if (gen->dl_inst->module != mod_inst->dl_inst->module) {
+		cf_log_err(cs, "Module \"%s\" can't be changed to a different type of module",
+			   mod_inst->name);
+		goto error;
+	}
+
+	if (mod_inst->module->config && (cf_section_parse_pass2(gen->dl_inst->data, cs) < 0)) goto error;
+
+	if (mod_inst->module->instantiate && ((mod_inst->module->instantiate)(gen->dl_inst->data, cs) < 0)) {
+		goto error;
+	}
+
+	if (gen->dl_inst->data) {
+		gen->memory_used = talloc_total_size(gen->dl_inst->data);
+		fr_memory_add(mod_inst->memory, gen->memory_used);
+	}
+
+#ifndef NDEBUG
+	if (gen->dl_inst->data) module_instance_read_only(gen->dl_inst->data, mod_inst->name);
+#endif
+
+	/*
+	 *	Requests which call the module from now on use the
+	 *	new generation.
+	 */
+	pthread_mutex_lock(mod_inst->hup_mutex);
+	old = mod_inst->generation;
+	old->next = mod_inst->retired;
+	mod_inst->retired = old;
+	mod_inst->generation = gen;
+	mod_inst->dl_inst = gen->dl_inst;
+	pthread_mutex_unlock(mod_inst->hup_mutex);
+
+	INFO(" Module: Reloaded module \"%s\"", mod_inst->name);
+
+	/*
+	 *	Free the old generation as soon as requests are done
+	 *	with it.
+	 */
+	if (el && !reap_ev) {
+		gettimeofday(&now, NULL);
+		_modules_reap(el, &now, NULL);
+	}
+
+	return 1;
+}
+
+/** Mark a module as needing to be reloaded, because a file it loaded has changed
+ *
+ * @param[in] modules	section of the running configuration.
+ * @param[in] cs	of the module which loaded the file.
+ * @return
+ *	- true if the module will be reloaded.
+ *	- false if the module can't be reloaded, or isn't using that file any more.
+ */
+bool module_hup_pending(CONF_SECTION *modules, CONF_SECTION *cs)
+{
+	module_instance_t	*mod_inst;
+	char const		*name;
+
+	name = cf_section_name2(cs);
+	if (!name) name = cf_section_name1(cs);
+
+	mod_inst = module_find(modules, name);
+	if (!mod_inst || !mod_inst->generation) return false;
+
+	/*
+	 *	The file was loaded by an older generation.
+	 */
+	if (mod_inst->dl_inst->conf != cs) return false;
+
+	mod_inst->hup_pending = true;
+
+	return true;
+}
+
+/** Whether a configuration item was added when the configuration was parsed
+ *
+ */
+static inline bool module_conf_item_ignore(CONF_ITEM const *ci)
+{
+	char const *filename;
+
+	if (cf_item_is_data(ci)) return true;
+
+	filename = cf_filename(ci);
+
+	return (!filename || (strcmp(filename, "<internal>") == 0));
+}
+
+/** Check whether two configurations of a module differ
+ *
+ * Items which weren't read from a file were added as defaults when the
+ * configuration was parsed, so they're ignored.
+ *
+ * @return
+ *	- true if the configurations differ.
+ *	- false if they're the same.
+ */
+static bool module_conf_changed(CONF_SECTION const *a, CONF_SECTION const *b)
+{
+	CONF_ITEM *ci_a = NULL, *ci_b = NULL;
+
+	if (strcmp(cf_section_name1(a), cf_section_name1(b)) != 0) return true;
+	if ((cf_section_name2(a) == NULL) != (cf_section_name2(b) == NULL)) return true;
+	if (cf_section_name2(a) && (strcmp(cf_section_name2(a), cf_section_name2(b)) != 0)) return true;
+
+	for (;;) {
+		do {
+			ci_a = cf_item_next(a, ci_a);
+		} while (ci_a && module_conf_item_ignore(ci_a));
+
+		do {
+			ci_b = cf_item_next(b, ci_b);
+		} while (ci_b && module_conf_item_ignore(ci_b));
+
+		if (!ci_a || !ci_b) break;
+
+		if (cf_item_is_section(ci_a)) {
+			if (!cf_item_is_section(ci_b)) return true;
+
+			if (module_conf_changed(cf_item_to_section(ci_a), cf_item_to_section(ci_b))) return true;
+			continue;
+		}
+
+		if (!cf_item_is_pair(ci_b)) return true;
+
+		{
+			CONF_PAIR const	*cp_a = cf_item_to_pair(ci_a), *cp_b = cf_item_to_pair(ci_b);
+			char const	*value_a = cf_pair_value(cp_a), *value_b = cf_pair_value(cp_b);
+
+			if (strcmp(cf_pair_attr(cp_a), cf_pair_attr(cp_b)) != 0) return true;
+			if (cf_pair_operator(cp_a) != cf_pair_operator(cp_b)) return true;
+			if ((value_a == NULL) != (value_b == NULL)) return true;
+			if (value_a && (strcmp(value_a, value_b) != 0)) return true;
+		}
+	}
+
+	return (ci_a != ci_b);
+}
+
+/** Reload modules whose configuration has changed
+ *
+ * Modules whose configuration is the same keep their instance data,
+ * connection pools included, unless a file they loaded has changed.
+ *
+ * @param[in] modules	section of the new configuration.
+ * @param[in] el	of the main thread, where old generations are freed.
+ * @return
+ *	- 0 on success.
+ *	- -1 if any module failed to reload.
+ */
+int modules_hup(CONF_SECTION *modules, fr_event_list_t *el)
+{
+	CONF_SECTION	*running, *cs = NULL;
+	time_t		when;
+	int		rcode = 0;
+
+	running = cf_section_find(main_config.config, "modules", NULL);
+	if (!modules || !running) return 0;
+
+	when = time(NULL);
+
+	while ((cs = cf_section_next(modules, cs))) {
+		module_instance_t	*mod_inst;
+		char const		*name;
+
+		name = cf_section_name2(cs);
+		if (!name) name = cf_section_name1(cs);
+
+		mod_inst = module_find(running, name);
+		if (!mod_inst) continue;
+
+		if (!mod_inst->hup_pending && !module_conf_changed(mod_inst->dl_inst->conf, cs)) continue;
+
+		if (!mod_inst->generation) {
+			cf_log_warn(cs, "Configuration of module \"%s\" has changed, but it can't be reloaded.  "
+				    "Restart the server to use the new configuration", name);
+			continue;
+		}
+
+		if (module_hup_module(mod_inst, cs, el, when) < 0) rcode = -1;
+	}
+
+	return rcode;
+}
+
 /** Free module's instance data, and any xlats or paircompares
  *
  * @param[in] mod_inst to free.
@@ -770,6 +1575,8 @@ int modules_instantiate(CONF_SECTION *root)
  */
 static int _module_instance_free(module_instance_t *mod_inst)
 {
+	module_generation_t *gen;
+
 	if (mod_inst->mutex) {
 		/*
 		 *	FIXME
@@ -791,6 +1598,19 @@ static int _module_instance_free(module_instance_t *mod_inst)
 		xlat_unregister_module(mod_inst->dl_inst->data);
 	}
 
+	/*
+	 *	The server is exiting, so nothing is using the old
+	 *	generations.  The first generation's instance data is
+	 *	freed along with the module instance.
+	 */
+	while ((gen = mod_inst->retired)) {
+		mod_inst->retired = gen->next;
+		module_generation_free(gen);
+	}
+	TALLOC_FREE(mod_inst->generation);
+
+	if (mod_inst->hup_mutex) pthread_mutex_destroy(mod_inst->hup_mutex);
+
 	/*
 	 *	We need to explicitly free all children, so the module instance
 	 *	destructors get executed before we unload the bytecode for the
@@ -824,6 +1644,7 @@ static module_instance_t *module_bootstrap(CONF_SECTION *modules, CONF_SECTION *
 	int			i;
 	char const		*name1, *inst_name;
 	module_instance_t	*mod_inst;
+	fr_startup_phase_t	*trace;
 
 	/*
 	 *	Figure out which module we want to load.
@@ -857,6 +1678,8 @@ static module_instance_t *module_bootstrap(CONF_SECTION *modules, CONF_SECTION *
 		return NULL;
 	}
 
+	trace = fr_startup_trace_start("module.bootstrap", "%s", inst_name);
+
 	MEM(mod_inst = talloc_zero(instance_ctx, module_instance_t));
 	talloc_set_destructor(mod_inst, _module_instance_free);
 
@@ -883,6 +1706,9 @@ static module_instance_t *module_bootstrap(CONF_SECTION *modules, CONF_SECTION *
 	}
 
 	mod_inst->name = talloc_strdup(mod_inst, inst_name);
+	mod_inst->number = module_instance_num++;
+
+	fr_startup_trace_stop(trace);
 
 	/*
 	 *	Remember the module for later.
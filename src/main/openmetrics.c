@@ -0,0 +1,363 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file openmetrics.c
+ * @brief Write radsniff stats in OpenMetrics (Prometheus) text format.
+ *
+ * The metrics for the last stats interval are written to a file, and/or
+ * served over HTTP.  The HTTP server is as simple as it can be.  It ignores
+ * whatever was requested, and returns the metrics.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+#include <math.h>
+
+#include <freeradius-devel/radsniff.h>
+
+#define RS_OPENMETRICS_TIMEOUT	1	//!< How long we wait for an HTTP client, in seconds.
+
+static char const rs_openmetrics_type[] = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+
+/** Print a value, in the way OpenMetrics wants
+ *
+ */
+static char const *rs_openmetrics_value(char *out, size_t outlen, double value)
+{
+	if (isnan(value)) return "NaN";
+
+	snprintf(out, outlen, "%.9g", value);
+
+	return out;
+}
+
+/** Append a summary of latency stats
+ *
+ * @param[in,out] out	buffer to append to.
+ * @param[in] name	of the metric family.
+ * @param[in] labels	to identify the stats, without the trailing comma.
+ * @param[in] stats	to append.
+ */
+static void rs_openmetrics_latency(char **out, char const *name, char const *labels, rs_latency_t *stats)
+{
+	int		i;
+	char		buffer[64];
+	static char const *quantiles[RS_PERCENTILES] = { "0.5", "0.9", "0.99", "0.999" };
+
+	for (i = 0; i < RS_PERCENTILES; i++) {
+		*out = talloc_asprintf_append_buffer(*out, "%s{%s,quantile=\"%s\"} %s\n", name, labels, quantiles[i],
+						     rs_openmetrics_value(buffer, sizeof(buffer),
+									  stats->interval.latency_percentile[i] / 1000));
+	}
+	*out = talloc_asprintf_append_buffer(*out, "%s_sum{%s} %s\n", name, labels,
+					     rs_openmetrics_value(buffer, sizeof(buffer),
+								  (double) (stats->total.latency / 1000)));
+	*out = talloc_asprintf_append_buffer(*out, "%s_count{%s} %" PRIu64 "\n", name, labels, stats->total.linked);
+}
+
+typedef struct {
+	char		**out;				//!< Buffer to append to.
+	rs_peer_type_t	type;				//!< Type of peers to append.
+	char const	*name;				//!< Metric family.
+	char const	*label;				//!< Label for the peer's address.
+} rs_openmetrics_peer_ctx_t;
+
+static int _rs_openmetrics_peer(void *ctx, void *data)
+{
+	rs_openmetrics_peer_ctx_t	*pctx = ctx;
+	rs_peer_t			*peer = data;
+	char				ipaddr[FR_IPADDR_STRLEN];
+	char				labels[256];
+
+	if (peer->type != pctx->type) return 0;
+	if (!peer->stats.total.linked) return 0;
+
+	fr_inet_ntop(ipaddr, sizeof(ipaddr), &peer->ipaddr);
+	snprintf(labels, sizeof(labels), "%s=\"%s\",code=\"%s\"", pctx->label, ipaddr, fr_packet_codes[peer->code]);
+
+	rs_openmetrics_latency(pctx->out, pctx->name, labels, &peer->stats);
+
+	return 0;
+}
+
+/** Append the latency summaries for one type of peer
+ *
+ */
+static void rs_openmetrics_peers(char **out, rs_stats_t *stats, rs_peer_type_t type,
+				 char const *name, char const *label, char const *help)
+{
+	rs_openmetrics_peer_ctx_t pctx;
+
+	*out = talloc_asprintf_append_buffer(*out, "# TYPE %s summary\n# UNIT %s seconds\n# HELP %s %s\n",
+					     name, name, name, help);
+
+	pctx.out = out;
+	pctx.type = type;
+	pctx.name = name;
+	pctx.label = label;
+
+	fr_hash_table_walk(stats->peers, _rs_openmetrics_peer, &pctx);
+}
+
+/** Append a counter for each packet code
+ *
+ */
+static void rs_openmetrics_counter(char **out, rs_stats_t *stats, int const *codes, size_t num_codes,
+				   char const *name, char const *help, size_t offset)
+{
+	size_t i;
+
+	*out = talloc_asprintf_append_buffer(*out, "# TYPE %s counter\n# HELP %s %s\n", name, name, help);
+
+	for (i = 0; i < num_codes; i++) {
+		rs_latency_t *latency = &stats->exchange[codes[i]];
+
+		if (!latency->total.received) continue;
+
+		*out = talloc_asprintf_append_buffer(*out, "%s_total{code=\"%s\"} %" PRIu64 "\n", name,
+						     fr_packet_codes[codes[i]],
+						     *((uint64_t *) (((uint8_t *) latency) + offset)));
+	}
+}
+
+/** Write the metrics to a file
+ *
+ * The metrics are written to a temporary file, which is renamed over the
+ * real one, so readers never see a partial file.
+ */
+static int rs_openmetrics_write(char const *file, char const *text)
+{
+	char	tmp[PATH_MAX];
+	FILE	*fp;
+	int	ret;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		ERROR("Failed opening \"%s\": %s", tmp, fr_syserror(errno));
+		return -1;
+	}
+
+	ret = fputs(text, fp);
+	if ((fclose(fp) != 0) || (ret < 0)) {
+		ERROR("Failed writing \"%s\": %s", tmp, fr_syserror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	if (rename(tmp, file) < 0) {
+		ERROR("Failed renaming \"%s\" to \"%s\": %s", tmp, file, fr_syserror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Generate the metrics for the last interval, and write them out
+ *
+ * Must be called after the stats for the interval have been processed.
+ *
+ * @param[in] conf		radsniff configuration.
+ * @param[in] stats		for the interval.
+ * @param[in] codes		packet codes to write stats for.
+ * @param[in] num_codes		number of packet codes.
+ */
+void rs_stats_openmetrics_do_stats(rs_t *conf, rs_stats_t *stats, int const *codes, size_t num_codes)
+{
+	char	*out;
+	size_t	i;
+
+	out = talloc_typed_strdup(conf, "");
+	if (!out) return;
+
+	rs_openmetrics_counter(&out, stats, codes, num_codes, "radsniff_received",
+			       "RADIUS packets received.", offsetof(rs_latency_t, total.received));
+	rs_openmetrics_counter(&out, stats, codes, num_codes, "radsniff_linked",
+			       "Requests and responses we linked.", offsetof(rs_latency_t, total.linked));
+	rs_openmetrics_counter(&out, stats, codes, num_codes, "radsniff_unlinked",
+			       "Responses with no request.", offsetof(rs_latency_t, total.unlinked));
+	rs_openmetrics_counter(&out, stats, codes, num_codes, "radsniff_reused",
+			       "IDs re-used too quickly.", offsetof(rs_latency_t, total.reused));
+	rs_openmetrics_counter(&out, stats, codes, num_codes, "radsniff_lost",
+			       "Requests with no response.", offsetof(rs_latency_t, total.lost));
+
+	out = talloc_asprintf_append_buffer(out, "# TYPE radsniff_latency_seconds summary\n"
+					    "# UNIT radsniff_latency_seconds seconds\n"
+					    "# HELP radsniff_latency_seconds Latency between requests and responses.  "
+					    "Quantiles are for the last interval.\n");
+	for (i = 0; i < num_codes; i++) {
+		char labels[64];
+
+		if (!stats->exchange[codes[i]].total.linked) continue;
+
+		snprintf(labels, sizeof(labels), "code=\"%s\"", fr_packet_codes[codes[i]]);
+		rs_openmetrics_latency(&out, "radsniff_latency_seconds", labels, &stats->exchange[codes[i]]);
+	}
+
+	if (stats->peers) {
+		rs_openmetrics_peers(&out, stats, RS_PEER_NAS, "radsniff_nas_latency_seconds", "nas",
+				     "Latency of requests sent by each NAS.  Quantiles are for the last interval.");
+		rs_openmetrics_peers(&out, stats, RS_PEER_HOME_SERVER, "radsniff_home_server_latency_seconds",
+				     "home_server",
+				     "Latency of requests sent to each home server.  "
+				     "Quantiles are for the last interval.");
+	}
+
+	out = talloc_asprintf_append_buffer(out, "# EOF\n");
+	if (!out) {
+		ERROR("Out of memory generating OpenMetrics");
+		return;
+	}
+
+	talloc_free(conf->metrics.text);
+	conf->metrics.text = out;
+
+	if (conf->metrics.file) rs_openmetrics_write(conf->metrics.file, out);
+}
+
+/** Write all of a buffer to a socket
+ *
+ */
+static int rs_openmetrics_send(int fd, char const *data, size_t len)
+{
+	ssize_t slen;
+
+	while (len > 0) {
+		slen = send(fd, data, len, MSG_NOSIGNAL);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		data += slen;
+		len -= slen;
+	}
+
+	return 0;
+}
+
+/** Accept a connection, and send the metrics for the last interval
+ *
+ */
+static void rs_openmetrics_accept(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *ctx)
+{
+	rs_t		*conf = ctx;
+	int		client;
+	char		buffer[1024];
+	char const	*body;
+	size_t		len;
+	struct timeval	tv = { RS_OPENMETRICS_TIMEOUT, 0 };
+
+	client = accept(fd, NULL, NULL);
+	if (client < 0) return;
+
+	/*
+	 *	Some platforms have accepted sockets inherit O_NONBLOCK
+	 *	from the listener.  We want to block, but not for long,
+	 *	so a slow client doesn't hold up the event loop.
+	 */
+	if (fr_blocking(client) < 0) goto done;
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/*
+	 *	We only have one thing to serve, so we don't care
+	 *	what was asked for.  But we read the request, so the
+	 *	client doesn't see a reset when we close.
+	 */
+	if (recv(client, buffer, sizeof(buffer), 0) < 0) goto done;
+
+	body = conf->metrics.text ? conf->metrics.text : "# EOF\n";
+	len = snprintf(buffer, sizeof(buffer),
+		       "HTTP/1.0 200 OK\r\n"
+		       "Content-Type: %s\r\n"
+		       "Content-Length: %zu\r\n"
+		       "Connection: close\r\n"
+		       "\r\n", rs_openmetrics_type, strlen(body));
+
+	if (rs_openmetrics_send(client, buffer, len) < 0) goto done;
+	rs_openmetrics_send(client, body, strlen(body));
+
+done:
+	close(client);
+}
+
+/** Open the HTTP listener, if one was configured
+ *
+ * @param[in] conf	radsniff configuration.
+ * @param[in] el	to insert the listener into.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int rs_stats_openmetrics_open(rs_t *conf, fr_event_list_t *el)
+{
+	fr_ipaddr_t	ipaddr;
+	uint16_t	port;
+
+	conf->metrics.sockfd = -1;
+	if (!conf->metrics.listen) return 0;
+
+	/*
+	 *	Just a port, listen on all addresses.
+	 */
+	if (!strchr(conf->metrics.listen, ':')) {
+		unsigned long num;
+		char *end;
+
+		num = strtoul(conf->metrics.listen, &end, 10);
+		if (*end || !num || (num > UINT16_MAX)) {
+			ERROR("Invalid metrics port \"%s\"", conf->metrics.listen);
+			return -1;
+		}
+		port = num;
+
+		memset(&ipaddr, 0, sizeof(ipaddr));
+		ipaddr.af = AF_INET;
+		ipaddr.prefix = 32;
+	} else if (fr_inet_pton_port(&ipaddr, &port, conf->metrics.listen, -1, AF_UNSPEC, true, true) < 0) {
+		ERROR("Invalid metrics address \"%s\": %s", conf->metrics.listen, fr_strerror());
+		return -1;
+	}
+
+	conf->metrics.sockfd = fr_socket_server_tcp(&ipaddr, &port, NULL, true);
+	if (conf->metrics.sockfd < 0) {
+		ERROR("Failed opening metrics socket: %s", fr_strerror());
+		return -1;
+	}
+
+	if (fr_socket_bind(conf->metrics.sockfd, &ipaddr, &port, NULL) < 0) {
+		ERROR("Failed binding metrics socket: %s", fr_strerror());
+	error:
+		close(conf->metrics.sockfd);
+		conf->metrics.sockfd = -1;
+		return -1;
+	}
+
+	if (listen(conf->metrics.sockfd, 8) < 0) {
+		ERROR("Failed listening on metrics socket: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if (fr_event_fd_insert(conf, el, conf->metrics.sockfd, rs_openmetrics_accept, NULL, NULL, conf) < 0) {
+		ERROR("Failed inserting metrics socket: %s", fr_strerror());
+		goto error;
+	}
+
+	return 0;
+}
@@ -465,6 +465,27 @@ void paircompare_unregister_instance(void *instance)
 	}
 }
 
+/** See whether a comparison function is registered for an attribute
+ *
+ * Check items for these attributes may match without the attribute being
+ * in the request.
+ *
+ * @param[in] attribute	to look for.
+ * @return
+ *	- true if a comparison function is registered.
+ *	- false if the attribute is compared with the same attribute in the request.
+ */
+bool paircompare_registered(fr_dict_attr_t const *attribute)
+{
+	struct cmp *c;
+
+	for (c = cmp; c; c = c->next) {
+		if (c->attribute == attribute) return true;
+	}
+
+	return false;
+}
+
 /** Compare two pair lists except for the password information.
  *
  * For every element in "check" at least one matching copy must be present
@@ -32,10 +32,13 @@ RCSID("$Id$")
 #include <freeradius-devel/heap.h>
 #include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/probe.h>
+#include <freeradius-devel/io/memory.h>
 
 typedef struct fr_pool_connection fr_pool_connection_t;
 
 static int connection_check(fr_pool_t *pool, REQUEST *request);
+static void connection_release(fr_pool_t *pool, REQUEST *request, fr_pool_connection_t *this);
 
 /** An individual connection within the connection pool
  *
@@ -54,6 +57,8 @@ struct fr_pool_connection {
 	struct timeval	last_released;  	//!< Time the connection was released.
 
 	uint32_t	num_uses;		//!< Number of times the connection has been reserved.
+	uint64_t	latency;		//!< Moving average of how long the connection is held
+						//!< for, in microseconds.
 	uint64_t	number;			//!< Unique ID assigned when the connection is created,
 						//!< these will monotonically increase over the
 						//!< lifetime of the connection pool.
@@ -65,11 +70,41 @@ struct fr_pool_connection {
 
 	bool		needs_reconnecting;	//!< Reconnect this connection before use.
 
+	size_t		memory_used;		//!< Size of the connection's ctx when it was opened.
+
 #ifdef PTHREAD_DEBUG
 	pthread_t	pthread_id;		//!< When 'in_use == true'.
 #endif
 };
 
+/** Connections owned by a single worker thread
+ *
+ * Connections held here are still "in use" as far as the rest of the pool
+ * is concerned, so they can be reserved and released by the owning thread
+ * without taking the pool mutex.
+ *
+ * @see fr_pool_thread_alloc
+ */
+struct fr_pool_thread {
+	fr_pool_t		*pool;		//!< Pool the connections belong to.  NULL if the
+						//!< pool has been freed.
+
+	fr_pool_thread_t	*next;		//!< Next set of connections owned by this thread.
+	fr_pool_thread_t	*next_in_pool;	//!< Next set of connections registered with the pool.
+
+	fr_pool_connection_t	**idle;		//!< Connections available to the thread.
+	uint32_t		num_idle;	//!< Number of entries in idle.
+
+	fr_pool_connection_t	**held;		//!< Connections the thread has reserved.
+	uint32_t		num_held;	//!< Number of entries in held.
+
+	uint64_t		reserved;	//!< Number of reservations satisfied from idle.
+};
+
+/** The connection sets owned by this thread, one per pool
+ */
+static _Thread_local fr_pool_thread_t *pool_thread_head;
+
 /** A connection pool
  *
  * Defines the configuration of the connection pool, all the counters and
@@ -106,11 +141,23 @@ struct fr_pool {
 	bool		spread;			//!< If true we spread requests over the connections,
 						//!< using the connection released longest ago, first.
 
+	uint32_t	per_thread;		//!< Idle connections each thread may keep for itself.
+
+	bool		prefer_fast;		//!< If true we use the connection with the lowest
+						//!< latency, first.
+	uint32_t	slow_factor;		//!< Close connections this many times slower than
+						//!< the pool average.
+	uint32_t	target_utilisation;	//!< Percentage of connections we want to be in use.
+	uint64_t	utilisation_avg;	//!< Moving average of utilisation, times 256.
+	fr_pool_thread_t *threads;		//!< Connection sets owned by threads.
+
 	fr_heap_t	*heap;			//!< For the next connection heap
 
 	fr_pool_connection_t	*head;		//!< Start of the connection list.
 	fr_pool_connection_t	*tail;		//!< End of the connection list.
 
+	fr_memory_t	*memory;		//!< Memory used by the connections.
+
 	pthread_mutex_t	mutex;			//!< Mutex used to keep consistent state when making
 						//!< modifications in threaded mode.
 	pthread_cond_t	done_spawn;		//!< Threads that need to ensure no spawning is in progress,
@@ -158,6 +205,10 @@ static const CONF_PARSER pool_config[] = {
 	{ FR_CONF_OFFSET("held_trigger_max", FR_TYPE_TIMEVAL, fr_pool_t, held_trigger_max), .dflt = "0.5" },
 	{ FR_CONF_OFFSET("retry_delay", FR_TYPE_UINT32, fr_pool_t, retry_delay), .dflt = "1" },
 	{ FR_CONF_OFFSET("spread", FR_TYPE_BOOL, fr_pool_t, spread), .dflt = "no" },
+	{ FR_CONF_OFFSET("per_thread", FR_TYPE_UINT32, fr_pool_t, per_thread), .dflt = "0" },
+	{ FR_CONF_OFFSET("prefer_fast", FR_TYPE_BOOL, fr_pool_t, prefer_fast), .dflt = "no" },
+	{ FR_CONF_OFFSET("slow_factor", FR_TYPE_UINT32, fr_pool_t, slow_factor), .dflt = "0" },
+	{ FR_CONF_OFFSET("target_utilisation", FR_TYPE_UINT32, fr_pool_t, target_utilisation), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -190,6 +241,55 @@ static int last_released_cmp(void const *one, void const *two)
 	       (b->last_released.tv_usec > a->last_released.tv_usec);
 }
 
+/** Order connections by lowest latency
+ *
+ * Connections with the same latency are ordered by reserved most recently.
+ */
+static int latency_cmp(void const *one, void const *two)
+{
+	fr_pool_connection_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->latency > b->latency) - (a->latency < b->latency);
+	if (ret != 0) return ret;
+
+	return last_reserved_cmp(one, two);
+}
+
+/** Minimum number of uses before a connection's latency is trusted
+ */
+#define LATENCY_MIN_SAMPLES	8
+
+/** Add a sample to a latency moving average
+ *
+ * Each sample has a weight of 1/8.
+ *
+ * @param[in,out] avg	to update.
+ * @param[in] sample	Time the connection was held for.
+ */
+static inline void latency_update(uint64_t *avg, struct timeval const *sample)
+{
+	uint64_t usec = ((uint64_t)sample->tv_sec * 1000000) + sample->tv_usec;
+
+	if (!*avg) {
+		*avg = usec;
+		return;
+	}
+
+	*avg = ((*avg * 7) + usec) / 8;
+}
+
+/** Check whether a connection is much slower than the rest of the pool
+ *
+ */
+static inline bool connection_slow(fr_pool_t *pool, fr_pool_connection_t *this)
+{
+	if (!pool->slow_factor || !pool->state.latency) return false;
+	if (this->num_uses < LATENCY_MIN_SAMPLES) return false;
+
+	return (this->latency > (pool->state.latency * pool->slow_factor));
+}
+
 /** Removes a connection from the connection list
  *
  * @note Must be called with the mutex held.
@@ -312,6 +412,75 @@ static fr_pool_connection_t *connection_find(fr_pool_t *pool, void *conn)
 	return NULL;
 }
 
+/** Find the connections this thread owns in a pool
+ *
+ * @param[in] pool	to find connections for.
+ * @return
+ *	- The thread's connections.
+ *	- NULL if the thread doesn't have any connections of its own.
+ */
+static inline fr_pool_thread_t *thread_find(fr_pool_t *pool)
+{
+	fr_pool_thread_t *t;
+
+	for (t = pool_thread_head; t; t = t->next) if (t->pool == pool) return t;
+
+	return NULL;
+}
+
+/** Record that the thread has reserved a connection
+ *
+ */
+static void thread_held_add(fr_pool_thread_t *t, fr_pool_connection_t *this)
+{
+	fr_pool_t *pool = t->pool;	/* Used by MEM() */
+
+	if (t->num_held == talloc_array_length(t->held)) {
+		MEM(t->held = talloc_realloc(t, t->held, fr_pool_connection_t *, (t->num_held * 2) + 1));
+	}
+	t->held[t->num_held++] = this;
+}
+
+/** Remove a connection from the ones the thread has reserved
+ *
+ * @param[in] t		Connections owned by the thread.
+ * @param[in] conn	handle to find.
+ * @return
+ *	- The connection.
+ *	- NULL if the connection wasn't reserved by the thread.
+ */
+static fr_pool_connection_t *thread_held_remove(fr_pool_thread_t *t, void *conn)
+{
+	uint32_t		i;
+	fr_pool_connection_t	*this;
+
+	for (i = 0; i < t->num_held; i++) {
+		this = t->held[i];
+		if (this->connection != conn) continue;
+
+		t->held[i] = t->held[--t->num_held];
+		return this;
+	}
+
+	return NULL;
+}
+
+/** Check whether a connection may be kept for the thread's own use
+ *
+ * Mirrors the checks done by #connection_manage.  Connections which fail
+ * them are returned to the pool, which closes them.
+ */
+static inline bool thread_usable(fr_pool_t *pool, fr_pool_connection_t *this, time_t now)
+{
+	if (this->needs_reconnecting) return false;
+	if ((pool->max_uses > 0) && (this->num_uses >= pool->max_uses)) return false;
+	if ((pool->lifetime > 0) && ((this->created + pool->lifetime) < now)) return false;
+	if ((pool->idle_timeout > 0) && ((this->last_released.tv_sec + pool->idle_timeout) < now)) return false;
+	if (connection_slow(pool, this)) return false;
+
+	return true;
+}
+
 /** Spawns a new connection
  *
  * Spawns a new connection using the create callback, and returns it for
@@ -472,6 +641,14 @@ static fr_pool_connection_t *connection_spawn(fr_pool_t *pool, REQUEST *request,
 	}
 	fr_talloc_link_ctx(this, ctx);
 
+	/*
+	 *	Nothing else has seen the ctx yet, so it's safe to
+	 *	measure.  Memory the library allocates itself, e.g.
+	 *	OpenSSL's, isn't counted.
+	 */
+	this->memory_used = talloc_total_size(ctx);
+	fr_memory_add(pool->memory, this->memory_used);
+
 	this->created = now;
 	this->connection = conn;
 	this->in_use = in_use;
@@ -566,6 +743,7 @@ static void connection_close_internal(fr_pool_t *pool, REQUEST *request, fr_pool
 
 	rad_assert(pool->state.num > 0);
 	pool->state.num--;
+	fr_memory_add(pool->memory, -(int64_t) this->memory_used);
 	talloc_free(this);
 }
 
@@ -627,6 +805,12 @@ static int connection_manage(fr_pool_t *pool, REQUEST *request, fr_pool_connecti
 		goto do_delete;
 	}
 
+	if (connection_slow(pool, this)) {
+		ROPTIONAL(RINFO, INFO, "Closing connection (%" PRIu64 "): Latency %" PRIu64 "us, pool average "
+			  "is %" PRIu64 "us", this->number, this->latency, pool->state.latency);
+		goto do_delete;
+	}
+
 	return 1;
 }
 
@@ -647,25 +831,54 @@ static int connection_manage(fr_pool_t *pool, REQUEST *request, fr_pool_connecti
  */
 static int connection_check(fr_pool_t *pool, REQUEST *request)
 {
-	uint32_t spawn, idle, extra;
+	uint32_t spawn, idle, extra, spare;
 	time_t now = time(NULL);
 	fr_pool_connection_t *this, *next;
 
+	/*
+	 *	Track how busy the pool is, each sample has a weight
+	 *	of 1/8.  Kept as a percentage times 256, so small
+	 *	changes aren't lost.
+	 */
+	if (pool->state.num) {
+		uint64_t sample = ((uint64_t)pool->state.active * 100 * 256) / pool->state.num;
+
+		pool->utilisation_avg = ((pool->utilisation_avg * 7) + sample) / 8;
+		pool->state.utilisation = pool->utilisation_avg / 256;
+	}
+
 	if (pool->state.last_checked == now) {
 		pthread_mutex_unlock(&pool->mutex);
 		return 1;
 	}
 
+	/*
+	 *	If we're aiming for a utilisation, work out how many
+	 *	spare connections are needed to get there, given how
+	 *	many connections have been in use recently.
+	 */
+	spare = pool->spare;
+	if (pool->target_utilisation) {
+		uint64_t	busy, wanted;
+
+		busy = (pool->utilisation_avg * pool->state.num) / (100 * 256);
+		if (busy < pool->state.active) busy = pool->state.active;
+
+		wanted = ((busy * 100) + pool->target_utilisation - 1) / pool->target_utilisation;
+		spare = (wanted > busy) ? (uint32_t)(wanted - busy) : 0;
+		if (spare > (pool->max - pool->min)) spare = pool->max - pool->min;
+	}
+
 	/*
 	 *	Some idle connections are OK, if they're within the
 	 *	configured "spare" range.  Any extra connections
 	 *	outside of that range can be closed.
 	 */
 	idle = pool->state.num - pool->state.active;
-	if (idle <= pool->spare) {
+	if (idle <= spare) {
 		extra = 0;
 	} else {
-		extra = idle - pool->spare;
+		extra = idle - spare;
 	}
 
 	/*
@@ -698,19 +911,19 @@ static int connection_check(fr_pool_t *pool, REQUEST *request)
 	 *	AND we don't have enough idle connections.
 	 *	Open some more.
 	 */
-	} else if (idle < pool->spare) {
+	} else if (idle < spare) {
 		/*
 		 *	Not enough spare connections.  Spawn a few.
 		 *	But cap the pool size at "max"
 		 */
-		spawn = pool->spare - idle;
+		spawn = spare - idle;
 		extra = 0;
 
 		if ((pool->state.num + pool->state.pending + spawn) > pool->max) {
 			spawn = pool->max - (pool->state.num + pool->state.pending);
 		}
 
-		ROPTIONAL(RINFO, INFO, "Need %i more connections to reach %i spares", spawn, pool->spare);
+		ROPTIONAL(RINFO, INFO, "Need %i more connections to reach %i spares", spawn, spare);
 
 	/*
 	 *	min < num < max
@@ -805,10 +1018,10 @@ done:
  * @param[in] request	The current request.
  * @param[in] spawn	whether to spawn a new connection
  * @return
- *	- A pointer to the connection handle.
+ *	- The reserved connection.
  *	- NULL on error.
  */
-static void *connection_get_internal(fr_pool_t *pool, REQUEST *request, bool spawn)
+static fr_pool_connection_t *connection_get_internal(fr_pool_t *pool, REQUEST *request, bool spawn)
 {
 	time_t now;
 	fr_pool_connection_t *this;
@@ -888,7 +1101,7 @@ do_return:
 
 	ROPTIONAL(RDEBUG2, DEBUG2, "Reserved connection (%" PRIu64 ")", this->number);
 
-	return this->connection;
+	return this;
 }
 
 /** Enable triggers for a connection pool
@@ -922,10 +1135,7 @@ void fr_pool_enable_triggers(fr_pool_t *pool, char const *trigger_prefix, VALUE_
  * Allocates structures used by the connection pool, initialises the various
  * configuration options and counters, and sets the callback functions.
  *
- * Will also spawn the number of connections specified by the 'start' configuration
- * option.
- *
- * @note Will call the 'start' trigger.
+ * No connections are opened until fr_pool_start() is called.
  *
  * @param[in] ctx		Context to link pool's destruction to.
  * @param[in] cs		pool section.
@@ -937,21 +1147,16 @@ void fr_pool_enable_triggers(fr_pool_t *pool, char const *trigger_prefix, VALUE_
  *	- New connection pool.
  *	- NULL on error.
  */
-fr_pool_t *fr_pool_init(TALLOC_CTX *ctx,
-			CONF_SECTION const *cs,
-			void *opaque,
-			fr_pool_connection_create_t c, fr_pool_connection_alive_t a,
-			char const *log_prefix)
+fr_pool_t *fr_pool_alloc(TALLOC_CTX *ctx,
+			 CONF_SECTION const *cs,
+			 void *opaque,
+			 fr_pool_connection_create_t c, fr_pool_connection_alive_t a,
+			 char const *log_prefix)
 {
-	uint32_t i;
 	fr_pool_t *pool = NULL;
-	fr_pool_connection_t *this;
-	time_t now;
 
 	if (!cs || !opaque || !c) return NULL;
 
-	now = time(NULL);
-
 	/*
 	 *	Pool is allocated in the NULL context as
 	 *	threads are likely to allocate memory
@@ -982,54 +1187,12 @@ fr_pool_t *fr_pool_init(TALLOC_CTX *ctx,
 
 	pool->head = pool->tail = NULL;
 
-	/*
-	 *	We keep a heap of connections, sorted by the last time
-	 *	we STARTED using them.  Newly opened connections
-	 *	aren't in the heap.  They're only inserted in the list
-	 *	once they're released.
-	 *
-	 *	We do "most recently started" instead of "most
-	 *	recently used", because MRU is done as most recently
-	 *	*released*.  We want to order connections by
-	 *	responsiveness, and MRU prioritizes high latency
-	 *	connections.
-	 *
-	 *	We want most recently *started*, which gives
-	 *	preference to low latency links, and pushes high
-	 *	latency links down in the priority heap.
-	 *
-	 *	https://code.facebook.com/posts/1499322996995183/solving-the-mystery-of-link-imbalance-a-metastable-failure-state-at-scale/
-	 */
-	if (!pool->spread) {
-		pool->heap = fr_heap_create(last_reserved_cmp, offsetof(fr_pool_t, heap));
-	/*
-	 *	For some types of connections we need to used a different
-	 *	algorithm, because load balancing benefits are secondary
-	 *	to maintaining a cache of open connections.
-	 *
-	 *	With libcurl's multihandle, connections can only be reused
-	 *	if all handles that make up the multhandle are done processing
-	 *	their requests.
-	 *
-	 *	We can't tell when that's happened using libcurl, and even
-	 *	if we could, blocking until all servers had responded
-	 *	would have huge cost.
-	 *
-	 *	The solution is to order the heap so that the connection that
-	 *	was released longest ago is at the top.
-	 *
-	 *	That way we maximise time between connection use.
-	 */
-	} else {
-		pool->heap = fr_heap_create(last_released_cmp, offsetof(fr_pool_t, heap));
-	}
-	if (!pool->heap) {
-		ERROR("%s: Failed creating connection heap", __FUNCTION__);
+	pool->log_prefix = log_prefix ? talloc_typed_strdup(pool, log_prefix) : "core";
+	pool->memory = fr_memory_alloc(pool, "pool", pool->log_prefix);
+	if (!pool->memory) {
 		talloc_free(pool);
 		return NULL;
 	}
-
-	pool->log_prefix = log_prefix ? talloc_typed_strdup(pool, log_prefix) : "core";
 	pthread_mutex_init(&pool->mutex, NULL);
 	pthread_cond_init(&pool->done_spawn, NULL);
 	pthread_cond_init(&pool->done_reconnecting, NULL);
@@ -1067,6 +1230,7 @@ fr_pool_t *fr_pool_init(TALLOC_CTX *ctx,
 	FR_INTEGER_BOUND_CHECK("max", pool->max, <=, 1024);
 	FR_INTEGER_BOUND_CHECK("start", pool->start, <=, pool->max);
 	FR_INTEGER_BOUND_CHECK("spare", pool->spare, <=, (pool->max - pool->min));
+	FR_INTEGER_BOUND_CHECK("per_thread", pool->per_thread, <=, pool->max);
 
 	if (pool->lifetime > 0) {
 		FR_INTEGER_COND_CHECK("idle_timeout", pool->idle_timeout, (pool->idle_timeout <= pool->lifetime), 0);
@@ -1083,15 +1247,105 @@ fr_pool_t *fr_pool_init(TALLOC_CTX *ctx,
 	 */
 	FR_TIMEVAL_BOUND_CHECK("connect_timeout", &pool->connect_timeout, >=, 0, 100000);
 
+	if (pool->prefer_fast && pool->spread) {
+		cf_log_err(cs, "Cannot set both 'prefer_fast' and 'spread'");
+		goto error;
+	}
+	FR_INTEGER_BOUND_CHECK("target_utilisation", pool->target_utilisation, <=, 100);
+
+	/*
+	 *	We keep a heap of connections, sorted by the last time
+	 *	we STARTED using them.  Newly opened connections
+	 *	aren't in the heap.  They're only inserted in the list
+	 *	once they're released.
+	 *
+	 *	We do "most recently started" instead of "most
+	 *	recently used", because MRU is done as most recently
+	 *	*released*.  We want to order connections by
+	 *	responsiveness, and MRU prioritizes high latency
+	 *	connections.
+	 *
+	 *	We want most recently *started*, which gives
+	 *	preference to low latency links, and pushes high
+	 *	latency links down in the priority heap.
+	 *
+	 *	https://code.facebook.com/posts/1499322996995183/solving-the-mystery-of-link-imbalance-a-metastable-failure-state-at-scale/
+	 */
+	if (!pool->spread && !pool->prefer_fast) {
+		pool->heap = fr_heap_create(last_reserved_cmp, offsetof(fr_pool_connection_t, heap));
+	/*
+	 *	For some types of connections we need to used a different
+	 *	algorithm, because load balancing benefits are secondary
+	 *	to maintaining a cache of open connections.
+	 *
+	 *	With libcurl's multihandle, connections can only be reused
+	 *	if all handles that make up the multhandle are done processing
+	 *	their requests.
+	 *
+	 *	We can't tell when that's happened using libcurl, and even
+	 *	if we could, blocking until all servers had responded
+	 *	would have huge cost.
+	 *
+	 *	The solution is to order the heap so that the connection that
+	 *	was released longest ago is at the top.
+	 *
+	 *	That way we maximise time between connection use.
+	 */
+	} else if (pool->spread) {
+		pool->heap = fr_heap_create(last_released_cmp, offsetof(fr_pool_connection_t, heap));
+
+	/*
+	 *	Or we can order connections by how long they've
+	 *	taken to do their work recently, which prefers fast
+	 *	connections, without the ordering being reset every
+	 *	time a slow connection is reserved.
+	 */
+	} else {
+		pool->heap = fr_heap_create(latency_cmp, offsetof(fr_pool_connection_t, heap));
+	}
+	if (!pool->heap) {
+		ERROR("%s: Failed creating connection heap", __FUNCTION__);
+		goto error;
+	}
+
 	/*
 	 *	Don't open any connections.  Instead, force the limits
 	 *	to only 1 connection.
 	 *
 	 */
-	if (check_config) {
-		pool->start = pool->min = pool->max = 1;
-		return pool;
-	}
+	if (check_config) pool->start = pool->min = pool->max = 1;
+
+	return pool;
+
+error:
+	fr_pool_free(pool);
+	return NULL;
+}
+
+/** Open the initial connections of a pool
+ *
+ * Spawns the number of connections specified by the 'start' configuration
+ * option.
+ *
+ * Only uses the pool, and the callbacks passed to fr_pool_alloc(), so
+ * it may be called from any thread.
+ *
+ * @note Will call the 'start' trigger.
+ *
+ * @param[in] pool	to open connections for.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_pool_start(fr_pool_t *pool)
+{
+	uint32_t i;
+	fr_pool_connection_t *this;
+	time_t now;
+
+	if (check_config) return 0;
+
+	now = time(NULL);
 
 	/*
 	 *	Create all of the connections, unless the admin says
@@ -1101,15 +1355,52 @@ fr_pool_t *fr_pool_init(TALLOC_CTX *ctx,
 		this = connection_spawn(pool, NULL, now, false, true);
 		if (!this) {
 			ERROR("Failed spawning initial connections");
-		error:
-			/* coverity[missing_unlock] */
-			fr_pool_free(pool);
-			return NULL;
+			return -1;
 		}
 	}
 
 	fr_pool_trigger_exec(pool, NULL, "start");
 
+	return 0;
+}
+
+/** Create a new connection pool
+ *
+ * Allocates structures used by the connection pool, initialises the various
+ * configuration options and counters, and sets the callback functions.
+ *
+ * Will also spawn the number of connections specified by the 'start' configuration
+ * option.
+ *
+ * @note Will call the 'start' trigger.
+ *
+ * @param[in] ctx		Context to link pool's destruction to.
+ * @param[in] cs		pool section.
+ * @param[in] opaque data	pointer to pass to callbacks.
+ * @param[in] c			Callback to create new connections.
+ * @param[in] a			Callback to check the status of connections.
+ * @param[in] log_prefix	prefix to prepend to all log messages.
+ * @return
+ *	- New connection pool.
+ *	- NULL on error.
+ */
+fr_pool_t *fr_pool_init(TALLOC_CTX *ctx,
+			CONF_SECTION const *cs,
+			void *opaque,
+			fr_pool_connection_create_t c, fr_pool_connection_alive_t a,
+			char const *log_prefix)
+{
+	fr_pool_t *pool;
+
+	pool = fr_pool_alloc(ctx, cs, opaque, c, a, log_prefix);
+	if (!pool) return NULL;
+
+	if (fr_pool_start(pool) < 0) {
+		/* coverity[missing_unlock] */
+		fr_pool_free(pool);
+		return NULL;
+	}
+
 	return pool;
 }
 
@@ -1141,6 +1432,23 @@ fr_pool_t *fr_pool_copy(TALLOC_CTX *ctx, fr_pool_t *pool, void *opaque)
  */
 fr_pool_state_t const *fr_pool_state(fr_pool_t *pool)
 {
+	fr_pool_thread_t *t;
+
+	if (!pool->threads) return &pool->state;
+
+	/*
+	 *	The counters are only written by the threads
+	 *	which own them, so may be slightly out of date.
+	 */
+	pthread_mutex_lock(&pool->mutex);
+	pool->state.thread_idle = 0;
+	pool->state.thread_reserved = 0;
+	for (t = pool->threads; t; t = t->next_in_pool) {
+		pool->state.thread_idle += t->num_idle;
+		pool->state.thread_reserved += t->reserved;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
 	return &pool->state;
 }
 
@@ -1304,6 +1612,19 @@ void fr_pool_free(fr_pool_t *pool)
 
 	pthread_mutex_lock(&pool->mutex);
 
+	/*
+	 *	Connections owned by threads are closed below,
+	 *	make sure the threads don't try to use them.
+	 */
+	while (pool->threads) {
+		fr_pool_thread_t *t = pool->threads;
+
+		pool->threads = t->next_in_pool;
+		t->pool = NULL;
+		t->num_idle = 0;
+		t->num_held = 0;
+	}
+
 	/*
 	 *	Don't loop over the list.  Just keep removing the head
 	 *	until they're all gone.
@@ -1329,50 +1650,19 @@ void fr_pool_free(fr_pool_t *pool)
 	talloc_free(pool);
 }
 
-/** Reserve a connection in the connection pool
+/** Return a reserved connection to the pool
  *
- * Will attempt to find an unused connection in the connection pool, if one is
- * found, will mark it as in in use increment the number of active connections
- * and return the connection handle.
- *
- * If no free connections are found will attempt to spawn a new one, conditional
- * on a connection spawning not already being in progress, and not being at the
- * 'max' connection limit.
- *
- * @note fr_pool_connection_release must be called once the caller has finished
- * using the connection.
- *
- * @see fr_pool_connection_release
- * @param[in] pool	to reserve the connection from.
- * @param[in] request	The current request.
- * @return
- *	- A pointer to the connection handle.
- *	- NULL on error.
- */
-void *fr_pool_connection_get(fr_pool_t *pool, REQUEST *request)
-{
-	return connection_get_internal(pool, request, true);
-}
-
-/** Release a connection
- *
- * Will mark a connection as unused and decrement the number of active
- * connections.
+ * @note Must be called with the mutex held, will release mutex before returning.
  *
- * @see fr_pool_connection_get
  * @param[in] pool	to release the connection in.
  * @param[in] request	The current request.
- * @param[in] conn	to release.
+ * @param[in] this	Connection to release.
  */
-void fr_pool_connection_release(fr_pool_t *pool, REQUEST *request, void *conn)
+static void connection_release(fr_pool_t *pool, REQUEST *request, fr_pool_connection_t *this)
 {
-	fr_pool_connection_t *this;
 	struct timeval	held;
 	bool trigger_min = false, trigger_max = false;
 
-	this = connection_find(pool, conn);
-	if (!this) return;
-
 	this->in_use = false;
 
 	/*
@@ -1386,6 +1676,8 @@ void fr_pool_connection_release(fr_pool_t *pool, REQUEST *request, void *conn)
 	 *	updates are atomic.
 	 */
 	fr_timeval_subtract(&held, &this->last_released, &this->last_reserved);
+	latency_update(&this->latency, &held);
+	latency_update(&pool->state.latency, &held);
 
 	/*
 	 *	Check we've not exceeded out trigger limits
@@ -1432,6 +1724,120 @@ void fr_pool_connection_release(fr_pool_t *pool, REQUEST *request, void *conn)
 	if (trigger_max) fr_pool_trigger_exec(pool, request, "max");
 }
 
+/** Reserve a connection in the connection pool
+ *
+ * Will attempt to find an unused connection in the connection pool, if one is
+ * found, will mark it as in in use increment the number of active connections
+ * and return the connection handle.
+ *
+ * If no free connections are found will attempt to spawn a new one, conditional
+ * on a connection spawning not already being in progress, and not being at the
+ * 'max' connection limit.
+ *
+ * @note fr_pool_connection_release must be called once the caller has finished
+ * using the connection.
+ *
+ * @see fr_pool_connection_release
+ * @param[in] pool	to reserve the connection from.
+ * @param[in] request	The current request.
+ * @return
+ *	- A pointer to the connection handle.
+ *	- NULL on error.
+ */
+void *fr_pool_connection_get(fr_pool_t *pool, REQUEST *request)
+{
+	fr_pool_connection_t	*this;
+	fr_pool_thread_t	*t;
+	time_t			now;
+
+	if (!pool) return NULL;
+
+	FR_PROBE1(pool_connection_get, pool->log_prefix);
+
+	t = thread_find(pool);
+	if (t) {
+		now = time(NULL);
+
+		while (t->num_idle > 0) {
+			this = t->idle[--t->num_idle];
+
+			if (!thread_usable(pool, this, now)) {
+				pthread_mutex_lock(&pool->mutex);
+				connection_release(pool, request, this);
+				continue;
+			}
+
+			this->num_uses++;
+			gettimeofday(&this->last_reserved, NULL);
+			t->reserved++;
+			thread_held_add(t, this);
+
+			ROPTIONAL(RDEBUG2, DEBUG2, "Reserved thread connection (%" PRIu64 ")", this->number);
+
+			FR_PROBE2(pool_connection_reserved, pool->log_prefix, this->number);
+			return this->connection;
+		}
+	}
+
+	this = connection_get_internal(pool, request, true);
+	if (!this) {
+		FR_PROBE2(pool_connection_reserved, pool->log_prefix, 0);
+		return NULL;
+	}
+
+	if (t) thread_held_add(t, this);
+
+	FR_PROBE2(pool_connection_reserved, pool->log_prefix, this->number);
+	return this->connection;
+}
+
+/** Release a connection
+ *
+ * Will mark a connection as unused and decrement the number of active
+ * connections.
+ *
+ * @see fr_pool_connection_get
+ * @param[in] pool	to release the connection in.
+ * @param[in] request	The current request.
+ * @param[in] conn	to release.
+ */
+void fr_pool_connection_release(fr_pool_t *pool, REQUEST *request, void *conn)
+{
+	fr_pool_connection_t	*this;
+	fr_pool_thread_t	*t;
+
+	if (!pool || !conn) return;
+
+	FR_PROBE2(pool_connection_release, pool->log_prefix, conn);
+
+	/*
+	 *	Keep the connection for this thread, if there's room,
+	 *	otherwise give it back to the pool.
+	 */
+	t = thread_find(pool);
+	if (t && ((this = thread_held_remove(t, conn)) != NULL)) {
+		struct timeval held;
+
+		gettimeofday(&this->last_released, NULL);
+		fr_timeval_subtract(&held, &this->last_released, &this->last_reserved);
+		latency_update(&this->latency, &held);
+
+		if ((t->num_idle < pool->per_thread) && thread_usable(pool, this, this->last_released.tv_sec)) {
+			t->idle[t->num_idle++] = this;
+
+			ROPTIONAL(RDEBUG2, DEBUG2, "Released thread connection (%" PRIu64 ")", this->number);
+			return;
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+	} else {
+		this = connection_find(pool, conn);
+		if (!this) return;
+	}
+
+	connection_release(pool, request, this);
+}
+
 /** Reconnect a suspected inviable connection
  *
  * This should be called by the module if it suspects that a connection is
@@ -1460,9 +1866,13 @@ void fr_pool_connection_release(fr_pool_t *pool, REQUEST *request, void *conn)
 void *fr_pool_connection_reconnect(fr_pool_t *pool, REQUEST *request, void *conn)
 {
 	fr_pool_connection_t	*this;
+	fr_pool_thread_t	*t;
 
 	if (!pool || !conn) return NULL;
 
+	t = thread_find(pool);
+	if (t) thread_held_remove(t, conn);
+
 	/*
 	 *	If connection_find is successful the pool is now locked
 	 */
@@ -1477,7 +1887,7 @@ void *fr_pool_connection_reconnect(fr_pool_t *pool, REQUEST *request, void *conn
 	/*
 	 *	Return an existing connection or spawn a new one.
 	 */
-	return connection_get_internal(pool, request, true);
+	return fr_pool_connection_get(pool, request);
 }
 
 /** Delete a connection from the connection pool.
@@ -1496,7 +1906,13 @@ void *fr_pool_connection_reconnect(fr_pool_t *pool, REQUEST *request, void *conn
  */
 int fr_pool_connection_close(fr_pool_t *pool, REQUEST *request, void *conn)
 {
-	fr_pool_connection_t *this;
+	fr_pool_connection_t	*this;
+	fr_pool_thread_t	*t;
+
+	if (!pool) return 0;
+
+	t = thread_find(pool);
+	if (t) thread_held_remove(t, conn);
 
 	this = connection_find(pool, conn);
 	if (!this) return 0;
@@ -1512,3 +1928,78 @@ int fr_pool_connection_close(fr_pool_t *pool, REQUEST *request, void *conn)
 	connection_check(pool, request);
 	return 1;
 }
+
+/** Return a thread's connections to the pool
+ *
+ */
+static int _pool_thread_free(fr_pool_thread_t *t)
+{
+	fr_pool_thread_t	**p;
+	fr_pool_t		*pool = t->pool;
+
+	for (p = &pool_thread_head; *p; p = &(*p)->next) {
+		if (*p != t) continue;
+
+		*p = t->next;
+		break;
+	}
+
+	if (!pool) return 0;
+
+	while (t->num_idle > 0) {
+		pthread_mutex_lock(&pool->mutex);
+		connection_release(pool, NULL, t->idle[--t->num_idle]);
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	for (p = &pool->threads; *p; p = &(*p)->next_in_pool) {
+		if (*p != t) continue;
+
+		*p = t->next_in_pool;
+		break;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return 0;
+}
+
+/** Give the calling thread connections of its own
+ *
+ * If the pool's "per_thread" option is non-zero, connections the calling
+ * thread releases are kept for its own use, up to that number, and are
+ * reserved again by the thread without taking the pool mutex.  Only
+ * spawning connections, closing them, and going to the rest of the pool
+ * when the thread has none left, require the mutex.
+ *
+ * Should be called from a module's thread_instantiate callback.  The
+ * connections are returned to the pool when the returned structure is
+ * freed, which must happen in the same thread, and before the pool is
+ * freed.  Parenting it to the module's thread instance data does this.
+ *
+ * @param[in] ctx	to allocate the connection set in.
+ * @param[in] pool	to take connections from.
+ * @return
+ *	- The thread's connection set.
+ *	- NULL if "per_thread" is zero, or the thread already has one.
+ */
+fr_pool_thread_t *fr_pool_thread_alloc(TALLOC_CTX *ctx, fr_pool_t *pool)
+{
+	fr_pool_thread_t *t;
+
+	if (!pool || !pool->per_thread || thread_find(pool)) return NULL;
+
+	MEM(t = talloc_zero(ctx, fr_pool_thread_t));
+	MEM(t->idle = talloc_array(t, fr_pool_connection_t *, pool->per_thread));
+	t->pool = pool;
+	talloc_set_destructor(t, _pool_thread_free);
+
+	t->next = pool_thread_head;
+	pool_thread_head = t;
+
+	pthread_mutex_lock(&pool->mutex);
+	t->next_in_pool = pool->threads;
+	pool->threads = t;
+	pthread_mutex_unlock(&pool->mutex);
+
+	return t;
+}
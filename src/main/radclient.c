@@ -89,13 +89,21 @@ static void NEVER_RETURNS usage(void)
 	fprintf(stderr, "  -F                     Print the file name, packet number and reply code.\n");
 	fprintf(stderr, "  -h                     Print usage help information.\n");
 	fprintf(stderr, "  -i <id>                Set request id to 'id'.  Values may be 0..255\n");
+	fprintf(stderr, "  -k <file>              Read the secrets of the clients in a replayed capture from file.\n");
+	fprintf(stderr, "  -l <seconds>           Generate load for 'seconds' (defaults to 10).\n");
+	fprintf(stderr, "  -L <rate>[:poisson]    Generate load at 'rate' packets/s, using the packets read as templates.\n");
+	fprintf(stderr, "                         \"%%n\" in User-Name or Acct-Session-Id is replaced by a counter.\n");
+	fprintf(stderr, "  -m <speed>             Replay the capture 'speed' times faster (0 for as fast as possible).\n");
 	fprintf(stderr, "  -n <num>               Send N requests/s\n");
+	fprintf(stderr, "  -o <num>               Send load or replay from 'num' source ports per thread (defaults to 16).\n");
 	fprintf(stderr, "  -p <num>               Send 'num' packets from a file in parallel.\n");
 	fprintf(stderr, "  -q                     Do not print anything out.\n");
 	fprintf(stderr, "  -r <retries>           If timeout, retry sending the packet 'retries' times.\n");
+	fprintf(stderr, "  -R <file>              Replay the requests in a pcap file, and compare the replies.\n");
 	fprintf(stderr, "  -s                     Print out summary information of auth results.\n");
 	fprintf(stderr, "  -S <file>              read secret from file, not command line.\n");
 	fprintf(stderr, "  -t <timeout>           Wait 'timeout' seconds before retrying (may be a floating point number).\n");
+	fprintf(stderr, "  -T <threads>           Generate load from 'threads' threads (defaults to 1).\n");
 	fprintf(stderr, "  -v                     Show program version information.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
 
@@ -1147,6 +1155,15 @@ int main(int argc, char **argv)
 	rc_request_t	*this;
 	int		force_af = AF_UNSPEC;
 	fr_dict_t	*dict = NULL;
+	rc_load_config_t load = {
+		.threads = 1,
+		.ports = 16,
+		.duration = 10
+	};
+	rc_replay_config_t replay = {
+		.speed = 1
+	};
+	uint16_t	replay_port;
 
 	/*
 	 *	It's easier having two sets of flags to set the
@@ -1172,7 +1189,7 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	while ((c = getopt(argc, argv, "46c:d:D:f:Fhi:n:p:qr:sS:t:vx"
+	while ((c = getopt(argc, argv, "46c:d:D:f:Fhi:k:l:L:m:n:o:p:qr:R:sS:t:T:vx"
 #ifdef WITH_TCP
 		"P:"
 #endif
@@ -1233,11 +1250,51 @@ int main(int argc, char **argv)
 			}
 			break;
 
+		case 'k':
+			replay.secrets = optarg;
+			break;
+
+		case 'l':
+			load.duration = atof(optarg);
+			if (load.duration <= 0) usage();
+			break;
+
+		case 'L':
+		{
+			char *p;
+
+			load.rate = strtod(optarg, &p);
+			if (load.rate <= 0) usage();
+
+			if (*p == ':') {
+				if (strcmp(p + 1, "poisson") != 0) usage();
+				load.poisson = true;
+			} else if (*p) {
+				usage();
+			}
+		}
+			break;
+
+		case 'm':
+		{
+			char *p;
+
+			replay.speed = strtod(optarg, &p);
+			if (*p || (replay.speed < 0)) usage();
+		}
+			break;
+
 		case 'n':
 			persec = atoi(optarg);
 			if (persec <= 0) usage();
 			break;
 
+		case 'o':
+			if (!isdigit((int) *optarg)) usage();
+			load.ports = atoi(optarg);
+			if ((load.ports == 0) || (load.ports > 1024)) usage();
+			break;
+
 			/*
 			 *	Note that sending MANY requests in
 			 *	parallel can over-run the kernel
@@ -1277,6 +1334,10 @@ int main(int argc, char **argv)
 			if ((retries == 0) || (retries > 1000)) usage();
 			break;
 
+		case 'R':
+			replay.filename = optarg;
+			break;
+
 		case 's':
 			do_summary = true;
 			break;
@@ -1317,6 +1378,12 @@ int main(int argc, char **argv)
 			timeout = atof(optarg);
 			break;
 
+		case 'T':
+			if (!isdigit((int) *optarg)) usage();
+			load.threads = atoi(optarg);
+			if ((load.threads == 0) || (load.threads > 256)) usage();
+			break;
+
 		case 'v':
 			fr_debug_lvl = 1;
 			DEBUG("%s", radclient_version);
@@ -1383,6 +1450,7 @@ int main(int argc, char **argv)
 		 */
 		if (packet_code == FR_CODE_UNDEFINED) packet_code = radclient_get_code(server_port);
 	}
+	replay_port = server_port;
 	radclient_get_port(packet_code, &server_port);
 
 	/*
@@ -1390,6 +1458,43 @@ int main(int argc, char **argv)
 	 */
 	if (argv[3]) secret = talloc_strdup(NULL, argv[3]);
 
+	/*
+	 *	Replay mode reads its requests from the capture, not
+	 *	from the packet files.
+	 */
+	if (replay.filename) {
+		int rcode;
+
+#ifdef WITH_TCP
+		if (proto) {
+			ERROR("Replay mode only supports UDP");
+			exit(1);
+		}
+#endif
+		if (server_ipaddr.af == AF_UNSPEC) {
+			ERROR("Replay mode needs a server to send to");
+			exit(1);
+		}
+
+		memset(&replay.client_ipaddr, 0, sizeof(replay.client_ipaddr));
+		replay.client_ipaddr.af = server_ipaddr.af;
+		replay.server_ipaddr = server_ipaddr;
+		replay.server_port = replay_port;
+		replay.ports = load.ports;
+		replay.timeout = timeout;
+		replay.secret = secret;
+		replay.do_output = do_output;
+
+		rcode = rc_replay_run(&replay);
+		if (rcode < 0) ERROR("%s", fr_strerror());
+
+		talloc_free(filename_tree);
+		talloc_free(dict);
+		talloc_free(secret);
+
+		exit(rcode == 0 ? 0 : 1);
+	}
+
 	/*
 	 *	If no '-f' is specified, we're reading from stdin.
 	 */
@@ -1473,6 +1578,36 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 *	Load generation mode uses the packets as
+	 *	templates, and has its own sockets.
+	 */
+	if (load.rate > 0) {
+		int rcode;
+
+#ifdef WITH_TCP
+		if (proto) {
+			ERROR("Load generation mode only supports UDP");
+			exit(1);
+		}
+#endif
+		load.timeout = timeout;
+		load.client_ipaddr = client_ipaddr;
+		load.secret = secret;
+		load.do_output = do_output;
+
+		rcode = rc_load_run(&load, request_head);
+		if (rcode < 0) ERROR("%s", fr_strerror());
+
+		talloc_free(filename_tree);
+		fr_packet_list_free(packet_list);
+		while (request_head) TALLOC_FREE(request_head);
+		talloc_free(dict);
+		talloc_free(secret);
+
+		exit(rcode == 0 ? 0 : 1);
+	}
+
 	/*
 	 *	Walk over the packets to send, until
 	 *	we're all done.
@@ -0,0 +1,859 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file radclient_load.c
+ * @brief Load generation mode for radclient.
+ *
+ * The packets read by radclient are encoded once, as templates.  Each
+ * packet sent is a copy of a template with a new ID, and (where needed)
+ * a new Request Authenticator, User-Password, and signature.  A "%n" in
+ * User-Name or Acct-Session-Id is replaced by a ten digit counter which
+ * is unique to each packet.
+ *
+ * Packets are sent open-loop at a target rate, from several threads,
+ * each of which has several sockets so that it has more than 256 IDs.
+ * Replies are matched by socket and ID, and their latency is recorded
+ * in a log-linear histogram.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radclient.h>
+#include <freeradius-devel/net.h>
+#include <freeradius-devel/udp.h>
+
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+
+#define RC_LOAD_COUNTER_LEN	10		//!< Digits substituted for "%n".
+#define RC_LOAD_EXPIRE_INTERVAL	10000		//!< How often to look for lost requests (us).
+
+static bool do_output = true;
+
+/** A pre-encoded packet
+ *
+ */
+typedef struct rc_load_template {
+	uint8_t			*data;			//!< Encoded packet, with placeholders.
+	size_t			data_len;
+
+	ssize_t			counter[2];		//!< Offsets of the "%n" placeholders in User-Name
+							//!< and Acct-Session-Id, or -1.
+
+	ssize_t			password_offset;	//!< Offset of the User-Password value, or -1.
+	size_t			password_len;		//!< Length of the encrypted User-Password.
+	char const		*password;		//!< Cleartext password.
+	size_t			password_cleartext_len;
+
+	fr_ipaddr_t		dst_ipaddr;		//!< Where to send the packet.
+	uint16_t		dst_port;
+} rc_load_template_t;
+
+/** A request we're waiting for a reply to
+ *
+ */
+typedef struct rc_load_slot {
+	bool			used;
+	uint64_t		sent;			//!< When the request was sent (us).
+	uint8_t			header[RADIUS_HDR_LEN];	//!< Code, ID and Request Authenticator, for
+							//!< verifying the reply.
+} rc_load_slot_t;
+
+typedef struct rc_load_socket {
+	int			fd;
+	uint8_t			next_id;		//!< Next ID to try.
+	rc_load_slot_t		slot[256];		//!< Outstanding requests, by ID.
+} rc_load_socket_t;
+
+typedef struct rc_load_stats {
+	uint64_t		sent;			//!< Requests sent.
+	uint64_t		received;		//!< Valid replies received.
+	uint64_t		lost;			//!< Requests with no reply before the timeout.
+	uint64_t		stalled;		//!< Requests not sent, because all IDs were in use.
+	uint64_t		dropped;		//!< Requests the kernel wouldn't send.
+	uint64_t		invalid;		//!< Replies which failed verification.
+	uint64_t		unexpected;		//!< Replies to requests we'd given up on.
+	uint64_t		code[256];		//!< Replies by code.
+	rc_histogram_t		latency;		//!< Reply latency (us).
+} rc_load_stats_t;
+
+typedef struct rc_load_thread {
+	int			id;
+	pthread_t		pthread_id;
+	bool			running;
+
+	rc_load_config_t const	*config;
+	rc_load_template_t	*templates;
+	int			num_templates;
+	int			next_template;
+	fr_hmac_md5_key_t const	*hmac_key;
+
+	rc_load_socket_t	*sockets;
+	struct pollfd		*pfds;
+
+	uint8_t			*send_buffer;		//!< UDP_BATCH_MAX packets of the longest template.
+	size_t			send_buffer_len;	//!< Length of each packet in send_buffer.
+	uint8_t			*recv_buffer;		//!< UDP_BATCH_MAX packets of MAX_PACKET_LEN.
+
+	fr_randctx		rand;			//!< fr_rand() isn't thread safe.
+	uint64_t		counter;		//!< Next value to substitute for "%n".
+
+	rc_load_stats_t		stats;
+} rc_load_thread_t;
+
+static volatile sig_atomic_t rc_load_stop = 0;
+
+static void rc_load_signal(UNUSED int sig)
+{
+	if (rc_load_stop < 2) rc_load_stop++;
+}
+
+/** Return the time from a monotonic clock, in microseconds
+ *
+ */
+uint64_t rc_time_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static inline uint32_t rc_load_rand(rc_load_thread_t *thread)
+{
+	uint32_t num;
+
+	num = thread->rand.randrsl[thread->rand.randcnt++];
+	if (thread->rand.randcnt >= 256) {
+		thread->rand.randcnt = 0;
+		fr_isaac(&thread->rand);
+	}
+
+	return num;
+}
+
+/** Add a value to a histogram
+ *
+ * Values below 2^RC_HISTOGRAM_SUB_BITS get a bucket each.  Above that,
+ * each power of two is split into 2^RC_HISTOGRAM_SUB_BITS buckets.
+ */
+void rc_histogram_add(rc_histogram_t *h, uint64_t usec)
+{
+	unsigned int	msb, shift, i;
+
+	if (usec < (1 << RC_HISTOGRAM_SUB_BITS)) {
+		i = usec;
+	} else {
+		if (usec >= ((uint64_t) 1 << RC_HISTOGRAM_MAX_BITS)) usec = ((uint64_t) 1 << RC_HISTOGRAM_MAX_BITS) - 1;
+
+		for (msb = RC_HISTOGRAM_SUB_BITS; (usec >> (msb + 1)) != 0; msb++);
+
+		shift = msb - RC_HISTOGRAM_SUB_BITS;
+		i = ((shift + 1) << RC_HISTOGRAM_SUB_BITS) +
+		    ((usec >> shift) & ((1 << RC_HISTOGRAM_SUB_BITS) - 1));
+	}
+
+	h->bucket[i]++;
+	h->count++;
+}
+
+/** Return the lower bound and width of a histogram bucket, in microseconds
+ *
+ */
+static void rc_histogram_bucket(unsigned int i, double *low, double *width)
+{
+	unsigned int shift;
+
+	if (i < (1 << RC_HISTOGRAM_SUB_BITS)) {
+		*low = i;
+		*width = 1;
+		return;
+	}
+
+	shift = (i >> RC_HISTOGRAM_SUB_BITS) - 1;
+	*low = (double) (((1 << RC_HISTOGRAM_SUB_BITS) + (i & ((1 << RC_HISTOGRAM_SUB_BITS) - 1))) << shift);
+	*width = (double) (1 << shift);
+}
+
+/** Return the value at a percentile of a histogram, in milliseconds
+ *
+ */
+static double rc_histogram_percentile(rc_histogram_t const *h, double p)
+{
+	uint64_t	target, seen = 0;
+	unsigned int	i;
+	double		low, width;
+
+	if (!h->count) return 0;
+
+	target = ceil(p * h->count);
+	if (!target) target = 1;
+
+	for (i = 0; i < RC_HISTOGRAM_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= target) break;
+	}
+	if (i == RC_HISTOGRAM_BUCKETS) i--;
+
+	rc_histogram_bucket(i, &low, &width);
+
+	return (low + (width / 2)) / 1000;
+}
+
+/** Print percentiles, and the non-empty buckets of a histogram
+ *
+ */
+void rc_histogram_print(FILE *fp, rc_histogram_t const *h)
+{
+	static double const	percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	static char const	*names[] = { "p50", "p90", "p99", "p99.9" };
+	uint64_t		seen = 0;
+	unsigned int		i;
+
+	if (!h->count) return;
+
+	fprintf(fp, "Latency (ms):\n");
+	for (i = 0; i < (sizeof(percentiles) / sizeof(*percentiles)); i++) {
+		fprintf(fp, "\t%-14s: %.3f\n", names[i], rc_histogram_percentile(h, percentiles[i]));
+	}
+
+	fprintf(fp, "Latency histogram (ms):\n");
+	for (i = 0; i < RC_HISTOGRAM_BUCKETS; i++) {
+		double low, width;
+
+		if (!h->bucket[i]) continue;
+
+		seen += h->bucket[i];
+		rc_histogram_bucket(i, &low, &width);
+		fprintf(fp, "\t%10.3f - %10.3f : %12" PRIu64 " %7.3f%%\n",
+			low / 1000, (low + width) / 1000, h->bucket[i], (100.0 * seen) / h->count);
+	}
+}
+
+/** Find the value of the first instance of an attribute in an encoded packet
+ *
+ * @return offset of the value, or -1 if the attribute isn't in the packet.
+ */
+static ssize_t rc_load_attr_find(uint8_t const *data, size_t data_len, unsigned int attr, size_t *len)
+{
+	uint8_t const *p = data + RADIUS_HDR_LEN, *end = data + data_len;
+
+	while ((p + 2) <= end) {
+		if ((p[1] < 2) || ((p + p[1]) > end)) break;
+
+		if (p[0] == attr) {
+			*len = p[1] - 2;
+			return (p + 2) - data;
+		}
+		p += p[1];
+	}
+
+	return -1;
+}
+
+/** Replace "%n" in a string attribute with a placeholder for the counter
+ *
+ * @return offset of the placeholder within the value, or -1 if there isn't one.
+ */
+static ssize_t rc_load_placeholder(VALUE_PAIR *vps, unsigned int attr)
+{
+	VALUE_PAIR	*vp;
+	char const	*p;
+	char		*value;
+	ssize_t		offset;
+
+	vp = fr_pair_find_by_num(vps, 0, attr, TAG_ANY);
+	if (!vp || (vp->vp_type != FR_TYPE_STRING)) return -1;
+
+	p = strstr(vp->vp_strvalue, "%n");
+	if (!p) return -1;
+
+	offset = p - vp->vp_strvalue;
+	value = talloc_asprintf(NULL, "%.*s%0*u%s", (int) offset, vp->vp_strvalue,
+				RC_LOAD_COUNTER_LEN, 0, p + 2);
+	fr_pair_value_strcpy(vp, value);
+	talloc_free(value);
+
+	return offset;
+}
+
+/** Encode a request read by radclient, as a template
+ *
+ */
+static int rc_load_template_init(TALLOC_CTX *ctx, rc_load_template_t *t, rc_request_t *request, char const *secret)
+{
+	RADIUS_PACKET	*packet = request->packet;
+	VALUE_PAIR	*vp;
+	static unsigned int const attrs[] = { FR_USER_NAME, FR_ACCT_SESSION_ID };
+	ssize_t		placeholder[2];
+	size_t		i, len;
+
+	memset(t, 0, sizeof(*t));
+	t->password_offset = -1;
+
+	if (fr_pair_find_by_num(packet->vps, 0, FR_CHAP_PASSWORD, TAG_ANY) ||
+	    fr_pair_find_by_num(packet->vps, 0, FR_MS_CHAP_PASSWORD, TAG_ANY)) {
+		fr_strerror_printf("Request %" PRIu64 " in file %s: Only User-Password is supported "
+				   "in load generation mode", request->num, request->files->packets);
+		return -1;
+	}
+
+	for (i = 0; i < 2; i++) placeholder[i] = rc_load_placeholder(packet->vps, attrs[i]);
+
+	vp = fr_pair_find_by_num(packet->vps, 0, FR_USER_PASSWORD, TAG_ANY);
+	if (vp && request->password) {
+		fr_pair_value_strcpy(vp, request->password->vp_strvalue);
+		t->password = talloc_strdup(ctx, request->password->vp_strvalue);
+		t->password_cleartext_len = strlen(t->password);
+		if (t->password_cleartext_len > 128) t->password_cleartext_len = 128;
+	}
+
+	packet->id = 0;
+	fr_rand_bytes(packet->vector, sizeof(packet->vector));
+
+	if (packet->data) TALLOC_FREE(packet->data);
+	if (fr_radius_packet_encode(packet, NULL, secret) < 0) return -1;
+
+	t->data = talloc_memdup(ctx, packet->data, packet->data_len);
+	t->data_len = packet->data_len;
+	TALLOC_FREE(packet->data);
+
+	for (i = 0; i < 2; i++) {
+		ssize_t offset;
+
+		t->counter[i] = -1;
+		if (placeholder[i] < 0) continue;
+
+		offset = rc_load_attr_find(t->data, t->data_len, attrs[i], &len);
+		if ((offset < 0) || ((size_t) placeholder[i] + RC_LOAD_COUNTER_LEN > len)) {
+			fr_strerror_printf("Request %" PRIu64 " in file %s: Failed finding \"%%n\" in "
+					   "the encoded packet", request->num, request->files->packets);
+			return -1;
+		}
+		t->counter[i] = offset + placeholder[i];
+	}
+
+	if (t->password) {
+		size_t expected = AUTH_PASS_LEN;
+
+		/*
+		 *	The encrypted password is padded to a multiple
+		 *	of AUTH_PASS_LEN, which is the same for every
+		 *	packet.
+		 */
+		if (t->password_cleartext_len > 0) {
+			expected = ((t->password_cleartext_len + AUTH_PASS_LEN - 1) / AUTH_PASS_LEN) * AUTH_PASS_LEN;
+		}
+
+		t->password_offset = rc_load_attr_find(t->data, t->data_len, FR_USER_PASSWORD, &t->password_len);
+		if ((t->password_offset < 0) || (t->password_len != expected)) {
+			fr_strerror_printf("Request %" PRIu64 " in file %s: Failed finding User-Password in "
+					   "the encoded packet", request->num, request->files->packets);
+			return -1;
+		}
+	}
+
+	t->dst_ipaddr = packet->dst_ipaddr;
+	t->dst_port = packet->dst_port;
+
+	return 0;
+}
+
+/** Build one packet from a template
+ *
+ */
+static void rc_load_packet_build(rc_load_thread_t *thread, rc_load_template_t const *t, uint8_t *out, uint8_t id)
+{
+	char const	*secret = thread->config->secret;
+	uint64_t	counter;
+	int		i, j;
+
+	memcpy(out, t->data, t->data_len);
+	out[1] = id;
+
+	switch (out[0]) {
+	case FR_CODE_ACCESS_REQUEST:
+	case FR_CODE_STATUS_SERVER:
+		for (i = 0; i < 4; i++) {
+			uint32_t r = rc_load_rand(thread);
+
+			memcpy(out + 4 + (i * 4), &r, sizeof(r));
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (t->counter[i] < 0) continue;
+
+		counter = thread->counter;
+		for (j = RC_LOAD_COUNTER_LEN - 1; j >= 0; j--) {
+			out[t->counter[i] + j] = '0' + (counter % 10);
+			counter /= 10;
+		}
+	}
+	thread->counter += thread->config->threads;
+
+	if (t->password_offset >= 0) {
+		char	buffer[128];
+		size_t	len = t->password_cleartext_len;
+
+		memcpy(buffer, t->password, len);
+		fr_radius_encode_password(buffer, &len, secret, out + 4);
+		memcpy(out + t->password_offset, buffer, t->password_len);
+	}
+
+	(void) fr_radius_sign(out, NULL, (uint8_t const *) secret, talloc_array_length(secret) - 1,
+			      thread->hmac_key);
+}
+
+/** Send the requests which are due
+ *
+ * Requests are sent in batches, one socket per batch.  If a socket has
+ * no free ID, we move on to the next one.  If no socket has a free ID,
+ * the request is counted as stalled, and not sent.  The schedule is
+ * open-loop, so the next request is due at the same time either way.
+ */
+static void rc_load_send(rc_load_thread_t *thread, uint64_t now, double *next, double gap, uint32_t *sock_idx)
+{
+	rc_load_config_t const	*config = thread->config;
+	udp_datagram_t		dg[UDP_BATCH_MAX];
+	uint8_t			id[UDP_BATCH_MAX];
+	rc_load_socket_t	*sock = &thread->sockets[*sock_idx];
+	int			num = 0, sent, i;
+
+	while ((*next <= now) && (num < UDP_BATCH_MAX)) {
+		rc_load_template_t const	*t;
+		uint8_t				*packet;
+		uint32_t			tries;
+
+		/*
+		 *	This socket has no free ID.  Send what we
+		 *	have, or look for another socket.
+		 */
+		if (sock->slot[sock->next_id].used) {
+			if (num > 0) break;
+
+			for (tries = 1; tries < config->ports; tries++) {
+				*sock_idx = (*sock_idx + 1) % config->ports;
+				sock = &thread->sockets[*sock_idx];
+				if (!sock->slot[sock->next_id].used) break;
+			}
+
+			if (sock->slot[sock->next_id].used) {
+				thread->stats.stalled++;
+				goto next;
+			}
+		}
+
+		t = &thread->templates[thread->next_template++];
+		if (thread->next_template == thread->num_templates) thread->next_template = 0;
+
+		packet = thread->send_buffer + (num * thread->send_buffer_len);
+		id[num] = sock->next_id++;
+		rc_load_packet_build(thread, t, packet, id[num]);
+
+		memset(&dg[num], 0, sizeof(dg[num]));
+		dg[num].data = packet;
+		dg[num].data_len = t->data_len;
+		dg[num].dst_ipaddr = t->dst_ipaddr;
+		dg[num].dst_port = t->dst_port;
+
+		sock->slot[id[num]].used = true;
+		sock->slot[id[num]].sent = now;
+		memcpy(sock->slot[id[num]].header, packet, RADIUS_HDR_LEN);
+		num++;
+
+	next:
+		if (config->poisson) {
+			*next += -log((rc_load_rand(thread) + 1.0) / 4294967297.0) * gap;
+		} else {
+			*next += gap;
+		}
+	}
+
+	if (!num) return;
+
+	/*
+	 *	Datagrams are sent in order, so any which the kernel
+	 *	wouldn't take are at the end of the batch.
+	 */
+	sent = udp_send_batch(sock->fd, dg, num);
+	for (i = sent; i < num; i++) sock->slot[id[i]].used = false;
+
+	thread->stats.sent += sent;
+	thread->stats.dropped += num - sent;
+
+	*sock_idx = (*sock_idx + 1) % config->ports;
+}
+
+/** Read replies from a socket, and match them to requests
+ *
+ */
+static void rc_load_recv(rc_load_thread_t *thread, rc_load_socket_t *sock)
+{
+	char const		*secret = thread->config->secret;
+	udp_datagram_t		dg[UDP_BATCH_MAX];
+	int			num, i;
+	uint64_t		now;
+
+	do {
+		for (i = 0; i < UDP_BATCH_MAX; i++) {
+			dg[i].data = thread->recv_buffer + (i * MAX_PACKET_LEN);
+			dg[i].data_len = MAX_PACKET_LEN;
+		}
+
+		num = udp_recv_batch(sock->fd, dg, UDP_BATCH_MAX);
+		if (num <= 0) return;
+
+		now = rc_time_now();
+
+		for (i = 0; i < num; i++) {
+			rc_load_slot_t	*slot;
+			size_t		len = dg[i].data_len;
+			decode_fail_t	reason;
+
+			if (len < RADIUS_HDR_LEN) {
+				thread->stats.invalid++;
+				continue;
+			}
+
+			slot = &sock->slot[dg[i].data[1]];
+			if (!slot->used) {
+				thread->stats.unexpected++;
+				continue;
+			}
+
+			if (!fr_radius_ok(dg[i].data, &len, false, &reason) ||
+			    (fr_radius_verify(dg[i].data, slot->header, (uint8_t const *) secret,
+					      talloc_array_length(secret) - 1, thread->hmac_key) < 0)) {
+				thread->stats.invalid++;
+				continue;
+			}
+
+			slot->used = false;
+			thread->stats.received++;
+			thread->stats.code[dg[i].data[0]]++;
+			rc_histogram_add(&thread->stats.latency, now - slot->sent);
+		}
+	} while (num == UDP_BATCH_MAX);
+}
+
+/** Count requests which have been waiting longer than the timeout as lost
+ *
+ * @return the number of requests still outstanding.
+ */
+static uint64_t rc_load_expire(rc_load_thread_t *thread, uint64_t now, uint64_t timeout)
+{
+	uint32_t	i;
+	int		j;
+	uint64_t	outstanding = 0;
+
+	for (i = 0; i < thread->config->ports; i++) {
+		for (j = 0; j < 256; j++) {
+			rc_load_slot_t *slot = &thread->sockets[i].slot[j];
+
+			if (!slot->used) continue;
+
+			if ((now - slot->sent) >= timeout) {
+				slot->used = false;
+				thread->stats.lost++;
+				continue;
+			}
+			outstanding++;
+		}
+	}
+
+	return outstanding;
+}
+
+static void *rc_load_thread_main(void *arg)
+{
+	rc_load_thread_t	*thread = arg;
+	rc_load_config_t const	*config = thread->config;
+	uint64_t		now, start, end, timeout, last_expire;
+	double			next, gap;
+	uint32_t		sock_idx = 0, i;
+	sigset_t		sigset;
+
+	/*
+	 *	Signals are handled by the main thread.
+	 */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	timeout = config->timeout * 1000000;
+	gap = (1000000.0 * config->threads) / config->rate;
+
+	start = last_expire = rc_time_now();
+	end = start + (uint64_t) (config->duration * 1000000);
+
+	/*
+	 *	Stagger the threads, so they don't all send at once.
+	 */
+	next = start + ((gap * thread->id) / config->threads);
+
+	for (;;) {
+		int wait = 0;
+
+		now = rc_time_now();
+
+		if (!rc_load_stop && (now < end)) {
+			rc_load_send(thread, now, &next, gap, &sock_idx);
+
+			/*
+			 *	Wake up at least every 100ms, so
+			 *	that we notice when to stop.
+			 */
+			if (next > now) wait = (next - now) / 1000;
+			if (wait > 100) wait = 100;
+		} else {
+			/*
+			 *	Done sending, wait for the
+			 *	outstanding replies.
+			 */
+			if (rc_load_expire(thread, now, timeout) == 0) break;
+			if (rc_load_stop > 1) break;
+
+			wait = 1;
+		}
+
+		if (poll(thread->pfds, config->ports, wait) > 0) {
+			for (i = 0; i < config->ports; i++) {
+				if (!(thread->pfds[i].revents & POLLIN)) continue;
+
+				rc_load_recv(thread, &thread->sockets[i]);
+			}
+		}
+
+		if ((now - last_expire) >= RC_LOAD_EXPIRE_INTERVAL) {
+			rc_load_expire(thread, now, timeout);
+			last_expire = now;
+		}
+	}
+
+	/*
+	 *	Anything left over was interrupted.
+	 */
+	rc_load_expire(thread, UINT64_MAX, 0);
+
+	return NULL;
+}
+
+static void rc_load_stats_merge(rc_load_stats_t *out, rc_load_stats_t const *in)
+{
+	int i;
+
+	out->sent += in->sent;
+	out->received += in->received;
+	out->lost += in->lost;
+	out->stalled += in->stalled;
+	out->dropped += in->dropped;
+	out->invalid += in->invalid;
+	out->unexpected += in->unexpected;
+
+	for (i = 0; i < 256; i++) out->code[i] += in->code[i];
+
+	out->latency.count += in->latency.count;
+	for (i = 0; i < RC_HISTOGRAM_BUCKETS; i++) out->latency.bucket[i] += in->latency.bucket[i];
+}
+
+static void rc_load_stats_print(rc_load_stats_t const *stats, double elapsed)
+{
+	unsigned int		i;
+
+	if (!do_output) return;
+
+	fprintf(stdout, "Load summary:\n"
+		"\tElapsed       : %.3f s\n"
+		"\tSent          : %" PRIu64 " (%.0f/s)\n"
+		"\tReceived      : %" PRIu64 " (%.0f/s)\n"
+		"\tLost          : %" PRIu64 "\n"
+		"\tStalled       : %" PRIu64 "\n"
+		"\tDropped       : %" PRIu64 "\n"
+		"\tInvalid       : %" PRIu64 "\n"
+		"\tUnexpected    : %" PRIu64 "\n",
+		elapsed,
+		stats->sent, elapsed > 0 ? stats->sent / elapsed : 0,
+		stats->received, elapsed > 0 ? stats->received / elapsed : 0,
+		stats->lost, stats->stalled, stats->dropped, stats->invalid, stats->unexpected);
+
+	for (i = 1; i < 256; i++) {
+		if (!stats->code[i]) continue;
+
+		if ((i < FR_MAX_PACKET_CODE) && fr_packet_codes[i]) {
+			fprintf(stdout, "\t%-14s: %" PRIu64 "\n", fr_packet_codes[i], stats->code[i]);
+		} else {
+			fprintf(stdout, "\tCode %-9u: %" PRIu64 "\n", i, stats->code[i]);
+		}
+	}
+
+	rc_histogram_print(stdout, &stats->latency);
+}
+
+/** Run radclient in load generation mode
+ *
+ * @param[in] config	for load generation.
+ * @param[in] head	of the list of requests read from the input files.
+ *			These are used as templates.
+ * @return
+ *	- 0 if every request sent got a reply.
+ *	- 1 if requests were lost, or couldn't be sent.
+ *	- -1 on error.
+ */
+int rc_load_run(rc_load_config_t const *config, rc_request_t *head)
+{
+	TALLOC_CTX		*ctx;
+	rc_load_template_t	*templates;
+	rc_load_thread_t	*threads;
+	rc_load_stats_t		*stats;
+	rc_request_t		*this;
+	fr_hmac_md5_key_t	hmac_key;
+	int			num_templates = 0, i, rcode = -1;
+	uint32_t		j;
+	bool			failed = false;
+	size_t			max_len = 0;
+	uint64_t		start;
+	struct sigaction	act, old_int, old_term;
+
+	do_output = config->do_output;
+
+	ctx = talloc_init("radclient load");
+	if (!ctx) return -1;
+
+	for (this = head; this; this = this->next) num_templates++;
+
+	templates = talloc_zero_array(ctx, rc_load_template_t, num_templates);
+	threads = talloc_zero_array(ctx, rc_load_thread_t, config->threads);
+	stats = talloc_zero(ctx, rc_load_stats_t);	/* too big for the stack */
+	if (!templates || !threads || !stats) {
+		fr_strerror_printf("Out of memory");
+		goto finish;
+	}
+
+	for (i = 0, this = head; this; this = this->next, i++) {
+		if (rc_load_template_init(templates, &templates[i], this, config->secret) < 0) goto finish;
+		if (templates[i].data_len > max_len) max_len = templates[i].data_len;
+	}
+
+	fr_hmac_md5_key_init(&hmac_key, (uint8_t const *) config->secret, talloc_array_length(config->secret) - 1);
+
+	for (j = 0; j < config->threads; j++) {
+		rc_load_thread_t *thread = &threads[j];
+
+		thread->id = j;
+		thread->config = config;
+		thread->templates = templates;
+		thread->num_templates = num_templates;
+		thread->hmac_key = &hmac_key;
+		thread->counter = j;
+
+		fr_rand_bytes(thread->rand.randrsl, sizeof(thread->rand.randrsl));
+		fr_randinit(&thread->rand, 1);
+		thread->rand.randcnt = 0;
+
+		thread->sockets = talloc_zero_array(threads, rc_load_socket_t, config->ports);
+		if (!thread->sockets) {
+		oom:
+			fr_strerror_printf("Out of memory");
+			goto finish;
+		}
+		for (i = 0; i < (int) config->ports; i++) thread->sockets[i].fd = -1;
+
+		thread->pfds = talloc_zero_array(threads, struct pollfd, config->ports);
+		thread->send_buffer_len = max_len;
+		thread->send_buffer = talloc_array(threads, uint8_t, UDP_BATCH_MAX * max_len);
+		thread->recv_buffer = talloc_array(threads, uint8_t, UDP_BATCH_MAX * MAX_PACKET_LEN);
+		if (!thread->pfds || !thread->send_buffer || !thread->recv_buffer) goto oom;
+
+		for (i = 0; i < (int) config->ports; i++) {
+			fr_ipaddr_t	ipaddr = config->client_ipaddr;
+			uint16_t	port = 0;
+			int		fd;
+
+			fd = fr_socket_server_udp(&ipaddr, &port, NULL, true);
+			if (fd < 0) goto finish;
+			thread->sockets[i].fd = fd;
+
+			if (fr_socket_bind(fd, &ipaddr, &port, NULL) < 0) goto finish;
+
+			thread->sockets[i].next_id = fr_rand() & 0xff;
+			thread->pfds[i].fd = fd;
+			thread->pfds[i].events = POLLIN;
+		}
+	}
+
+	/*
+	 *	The first signal stops sending, the second stops
+	 *	waiting for replies.
+	 */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = rc_load_signal;
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGINT, &act, &old_int);
+	sigaction(SIGTERM, &act, &old_term);
+
+	start = rc_time_now();
+
+	for (j = 0; j < config->threads; j++) {
+		int ret;
+
+		ret = pthread_create(&threads[j].pthread_id, NULL, rc_load_thread_main, &threads[j]);
+		if (ret != 0) {
+			fr_strerror_printf("Failed creating thread: %s", fr_syserror(ret));
+			rc_load_stop = 2;
+			failed = true;
+			break;
+		}
+		threads[j].running = true;
+	}
+
+	for (j = 0; j < config->threads; j++) {
+		if (!threads[j].running) continue;
+
+		while (pthread_join(threads[j].pthread_id, NULL) == EINTR);
+		rc_load_stats_merge(stats, &threads[j].stats);
+	}
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+
+	if (failed) goto finish;
+
+	rc_load_stats_print(stats, (rc_time_now() - start) / 1000000.0);
+
+	rcode = ((stats->lost > 0) || (stats->stalled > 0) || (stats->dropped > 0)) ? 1 : 0;
+
+finish:
+	if (threads) for (j = 0; j < config->threads; j++) {
+		if (!threads[j].sockets) continue;
+
+		for (i = 0; i < (int) config->ports; i++) {
+			if (threads[j].sockets[i].fd >= 0) close(threads[j].sockets[i].fd);
+		}
+	}
+	talloc_free(ctx);
+
+	return rcode;
+}
@@ -0,0 +1,925 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file radclient_replay.c
+ * @brief pcap replay mode for radclient.
+ *
+ * The pcap file is read twice.  The first pass links each captured
+ * request to its captured reply, and records the reply code.  The
+ * second pass sends the requests to the server, with the captured
+ * timing (optionally sped up or slowed down).
+ *
+ * Each request is sent with a new ID.  If it was signed with a
+ * different secret to the one we're using, User-Password is
+ * re-encrypted.  Every request is re-signed.  The code of each reply
+ * is compared with the captured one, and the differences are printed.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radclient.h>
+
+#ifdef HAVE_LIBPCAP
+#include <freeradius-devel/pcap.h>
+#include <freeradius-devel/udp.h>
+
+#include <poll.h>
+#include <signal.h>
+
+#define RC_REPLAY_EXPIRE_INTERVAL	10000	//!< How often to look for lost requests (us).
+
+static bool do_output = true;
+
+/** A RADIUS packet read from the capture
+ *
+ * The data is only valid until the next packet is read.
+ */
+typedef struct rc_replay_packet {
+	struct timeval		ts;			//!< When the packet was captured.
+	fr_ipaddr_t		src_ipaddr;
+	uint16_t		src_port;
+	fr_ipaddr_t		dst_ipaddr;
+	uint16_t		dst_port;
+	uint8_t const		*data;
+	size_t			data_len;
+} rc_replay_packet_t;
+
+/** A captured request we haven't seen the reply to yet
+ *
+ */
+typedef struct rc_replay_key {
+	fr_ipaddr_t		client_ipaddr;
+	uint16_t		client_port;
+	fr_ipaddr_t		server_ipaddr;
+	uint16_t		server_port;
+	uint8_t			id;
+	uint64_t		index;			//!< Of the request in the capture.
+} rc_replay_key_t;
+
+/** The secret a captured client used
+ *
+ */
+typedef struct rc_replay_client {
+	fr_ipaddr_t		ipaddr;
+	char const		*secret;		//!< talloced.
+} rc_replay_client_t;
+
+typedef struct rc_replay_slot {
+	bool			used;
+	uint64_t		sent;			//!< When the request was sent (us).
+	uint64_t		index;			//!< Of the request in the capture.
+	uint8_t			header[RADIUS_HDR_LEN];	//!< Code, ID and Request Authenticator, for
+							//!< verifying the reply.
+} rc_replay_slot_t;
+
+typedef struct rc_replay_socket {
+	int			fd;
+	uint8_t			next_id;		//!< Next ID to try.
+	rc_replay_slot_t	slot[256];		//!< Outstanding requests, by ID.
+} rc_replay_socket_t;
+
+typedef struct rc_replay_stats {
+	uint64_t		sent;			//!< Requests sent.
+	uint64_t		received;		//!< Valid replies received.
+	uint64_t		lost;			//!< Requests with no reply before the timeout.
+	uint64_t		stalled;		//!< Requests not sent, because all IDs were in use.
+	uint64_t		dropped;		//!< Requests the kernel wouldn't send.
+	uint64_t		invalid;		//!< Requests we couldn't sign, and replies which
+							//!< failed verification.
+	uint64_t		unexpected;		//!< Replies to requests we'd given up on.
+	uint64_t		same;			//!< Replies with the same code as the captured one.
+	uint64_t		different;		//!< Replies with a different code, or missing replies.
+	rc_histogram_t		latency;		//!< Reply latency (us).
+} rc_replay_stats_t;
+
+typedef struct rc_replay {
+	rc_replay_config_t const *config;
+	fr_hmac_md5_key_t	hmac_key;		//!< For the server's secret.
+	fr_hash_table_t		*clients;		//!< Secrets of the captured clients.
+
+	uint8_t			*captured;		//!< Captured reply code for each request,
+							//!< or 0 if there wasn't a reply.
+	uint64_t		num_requests;		//!< Requests in the capture.
+
+	rc_replay_socket_t	*sockets;
+	struct pollfd		*pfds;
+	uint32_t		sock_idx;		//!< Socket to send the next batch from.
+	uint8_t			*send_buffer;		//!< UDP_BATCH_MAX packets of MAX_PACKET_LEN.
+	uint8_t			*recv_buffer;		//!< UDP_BATCH_MAX packets of MAX_PACKET_LEN.
+
+	fr_pcap_t		*in;			//!< Capture being replayed.
+	rc_replay_packet_t	packet;			//!< Next request to send.
+	bool			have_packet;		//!< Whether packet is valid.
+	uint64_t		index;			//!< Of packet in the capture.
+	uint64_t		first;			//!< When the first request was captured (us).
+	uint64_t		start;			//!< When we started sending (us).
+
+	rc_replay_stats_t	stats;
+} rc_replay_t;
+
+static volatile sig_atomic_t rc_replay_stop = 0;
+
+static void rc_replay_signal(UNUSED int sig)
+{
+	if (rc_replay_stop < 2) rc_replay_stop++;
+}
+
+static uint32_t rc_replay_ipaddr_hash(fr_ipaddr_t const *ipaddr, uint32_t hash)
+{
+	if (ipaddr->af == AF_INET) return fr_hash_update(&ipaddr->addr.v4, sizeof(ipaddr->addr.v4), hash);
+
+	return fr_hash_update(&ipaddr->addr.v6, sizeof(ipaddr->addr.v6), hash);
+}
+
+static uint32_t rc_replay_key_hash(void const *data)
+{
+	rc_replay_key_t const	*key = data;
+	uint32_t		hash;
+
+	hash = fr_hash(&key->id, sizeof(key->id));
+	hash = fr_hash_update(&key->client_port, sizeof(key->client_port), hash);
+	hash = fr_hash_update(&key->server_port, sizeof(key->server_port), hash);
+	hash = rc_replay_ipaddr_hash(&key->client_ipaddr, hash);
+
+	return rc_replay_ipaddr_hash(&key->server_ipaddr, hash);
+}
+
+static int rc_replay_key_cmp(void const *one, void const *two)
+{
+	rc_replay_key_t const	*a = one, *b = two;
+	int			ret;
+
+	ret = a->id - b->id;
+	if (ret != 0) return ret;
+
+	ret = a->client_port - b->client_port;
+	if (ret != 0) return ret;
+
+	ret = a->server_port - b->server_port;
+	if (ret != 0) return ret;
+
+	ret = fr_ipaddr_cmp(&a->client_ipaddr, &b->client_ipaddr);
+	if (ret != 0) return ret;
+
+	return fr_ipaddr_cmp(&a->server_ipaddr, &b->server_ipaddr);
+}
+
+static void rc_replay_key_free(void *data)
+{
+	talloc_free(data);
+}
+
+static uint32_t rc_replay_client_hash(void const *data)
+{
+	rc_replay_client_t const *client = data;
+
+	return rc_replay_ipaddr_hash(&client->ipaddr, 0);
+}
+
+static int rc_replay_client_cmp(void const *one, void const *two)
+{
+	rc_replay_client_t const *a = one, *b = two;
+
+	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+}
+
+static bool rc_replay_is_request(uint8_t code)
+{
+	switch (code) {
+	case FR_CODE_ACCESS_REQUEST:
+	case FR_CODE_ACCOUNTING_REQUEST:
+	case FR_CODE_STATUS_SERVER:
+	case FR_CODE_COA_REQUEST:
+	case FR_CODE_DISCONNECT_REQUEST:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static char const *rc_replay_code_name(uint8_t code)
+{
+	if (!code) return "no reply";
+
+	if ((code < FR_MAX_PACKET_CODE) && fr_packet_codes[code]) return fr_packet_codes[code];
+
+	return "unknown code";
+}
+
+/** Read the secrets used by the captured clients
+ *
+ * Each line is "<address> <secret>".  Blank lines, and everything after
+ * a '#', are ignored.
+ */
+static int rc_replay_secrets_load(rc_replay_t *replay, char const *filename)
+{
+	FILE	*fp;
+	char	buffer[1024];
+	int	lineno = 0;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fr_strerror_printf("Error opening %s: %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		rc_replay_client_t	*client;
+		char			*p, *address, *secret;
+
+		lineno++;
+
+		p = strchr(buffer, '#');
+		if (p) *p = '\0';
+
+		address = strtok(buffer, " \t\r\n");
+		if (!address) continue;
+
+		secret = strtok(NULL, " \t\r\n");
+		if (!secret || strtok(NULL, " \t\r\n")) {
+			fr_strerror_printf("%s[%d]: Expected \"<address> <secret>\"", filename, lineno);
+			goto error;
+		}
+
+		client = talloc_zero(replay->clients, rc_replay_client_t);
+		if (fr_inet_pton(&client->ipaddr, address, -1, AF_UNSPEC, true, false) < 0) {
+			fr_strerror_printf("%s[%d]: %s", filename, lineno, fr_strerror());
+			talloc_free(client);
+			goto error;
+		}
+		client->secret = talloc_strdup(client, secret);
+
+		if (!fr_hash_table_insert(replay->clients, client)) {
+			fr_strerror_printf("%s[%d]: Duplicate client %s", filename, lineno, address);
+			talloc_free(client);
+			goto error;
+		}
+	}
+
+	fclose(fp);
+	return 0;
+
+error:
+	fclose(fp);
+	return -1;
+}
+
+static fr_pcap_t *rc_replay_open(TALLOC_CTX *ctx, char const *filename)
+{
+	fr_pcap_t *in;
+
+	in = fr_pcap_init(ctx, filename, PCAP_FILE_IN);
+	if (!in) return NULL;
+
+	if (fr_pcap_open(in) < 0) {
+		talloc_free(in);
+		return NULL;
+	}
+
+	if (fr_pcap_apply_filter(in, "udp") < 0) {
+		talloc_free(in);
+		return NULL;
+	}
+
+	return in;
+}
+
+/** Read the next well formed RADIUS packet from the capture
+ *
+ * @return
+ *	- 1 if a packet was read.
+ *	- 0 at the end of the capture.
+ *	- -1 on error.
+ */
+static int rc_replay_read(fr_pcap_t *in, rc_replay_packet_t *packet)
+{
+	struct pcap_pkthdr	*header;
+	uint8_t const		*data, *p, *end;
+	udp_header_t const	*udp;
+	ssize_t			len;
+	size_t			radius_len;
+	decode_fail_t		reason;
+	int			ret;
+
+	for (;;) {
+		ret = pcap_next_ex(in->handle, &header, &data);
+		if (ret == -2) return 0;
+		if (ret < 0) {
+			fr_strerror_printf("Error reading %s: %s", in->name, pcap_geterr(in->handle));
+			return -1;
+		}
+		if (ret == 0) continue;
+
+		memset(packet, 0, sizeof(*packet));
+		end = data + header->caplen;
+
+		len = fr_link_layer_offset(data, header->caplen, in->link_layer);
+		if (len < 0) continue;
+		p = data + len;
+
+		if (p >= end) continue;
+
+		switch (p[0] >> 4) {
+		case 4:
+		{
+			ip_header_t const *ip = (ip_header_t const *) p;
+
+			if ((p + sizeof(*ip)) > end) continue;
+			if (ip->ip_p != IPPROTO_UDP) continue;
+
+			packet->src_ipaddr.af = AF_INET;
+			packet->src_ipaddr.addr.v4 = ip->ip_src;
+			packet->src_ipaddr.prefix = 32;
+			packet->dst_ipaddr.af = AF_INET;
+			packet->dst_ipaddr.addr.v4 = ip->ip_dst;
+			packet->dst_ipaddr.prefix = 32;
+
+			p += (0x0f & ip->ip_vhl) * 4;
+		}
+			break;
+
+		case 6:
+		{
+			ip_header6_t const *ip6 = (ip_header6_t const *) p;
+
+			if ((p + sizeof(*ip6)) > end) continue;
+			if (ip6->ip_next != IPPROTO_UDP) continue;
+
+			packet->src_ipaddr.af = AF_INET6;
+			packet->src_ipaddr.addr.v6 = ip6->ip_src;
+			packet->src_ipaddr.prefix = 128;
+			packet->dst_ipaddr.af = AF_INET6;
+			packet->dst_ipaddr.addr.v6 = ip6->ip_dst;
+			packet->dst_ipaddr.prefix = 128;
+
+			p += sizeof(*ip6);
+		}
+			break;
+
+		default:
+			continue;
+		}
+
+		if ((p + sizeof(udp_header_t) + RADIUS_HDR_LEN) > end) continue;
+
+		udp = (udp_header_t const *) p;
+		p += sizeof(udp_header_t);
+
+		/*
+		 *	Ignore any trailing garbage the capture
+		 *	device added.
+		 */
+		if (ntohs(udp->len) < (sizeof(udp_header_t) + RADIUS_HDR_LEN)) continue;
+		radius_len = ntohs(udp->len) - sizeof(udp_header_t);
+		if ((p + radius_len) > end) continue;
+
+		if (!fr_radius_ok(p, &radius_len, false, &reason)) continue;
+
+		packet->ts = header->ts;
+		packet->src_port = ntohs(udp->src);
+		packet->dst_port = ntohs(udp->dst);
+		packet->data = p;
+		packet->data_len = radius_len;
+
+		return 1;
+	}
+}
+
+/** Read the next request from the capture
+ *
+ */
+static int rc_replay_read_request(fr_pcap_t *in, rc_replay_packet_t *packet)
+{
+	int ret;
+
+	while ((ret = rc_replay_read(in, packet)) > 0) {
+		if (rc_replay_is_request(packet->data[0])) return 1;
+	}
+
+	return ret;
+}
+
+/** Find the captured reply code for each captured request
+ *
+ */
+static int rc_replay_index(TALLOC_CTX *ctx, rc_replay_t *replay)
+{
+	fr_pcap_t		*in;
+	fr_hash_table_t		*outstanding;
+	rc_replay_packet_t	packet;
+	size_t			size = 1024;
+	int			ret;
+
+	in = rc_replay_open(ctx, replay->config->filename);
+	if (!in) return -1;
+
+	outstanding = fr_hash_table_create(ctx, rc_replay_key_hash, rc_replay_key_cmp, rc_replay_key_free);
+	replay->captured = talloc_zero_array(ctx, uint8_t, size);
+	if (!outstanding || !replay->captured) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	while ((ret = rc_replay_read(in, &packet)) > 0) {
+		rc_replay_key_t *key, search;
+
+		if (rc_replay_is_request(packet.data[0])) {
+			if (replay->num_requests == size) {
+				size *= 2;
+				replay->captured = talloc_realloc(ctx, replay->captured, uint8_t, size);
+				if (!replay->captured) {
+					fr_strerror_printf("Out of memory");
+					return -1;
+				}
+			}
+			replay->captured[replay->num_requests] = 0;
+
+			key = talloc_zero(ctx, rc_replay_key_t);
+			key->client_ipaddr = packet.src_ipaddr;
+			key->client_port = packet.src_port;
+			key->server_ipaddr = packet.dst_ipaddr;
+			key->server_port = packet.dst_port;
+			key->id = packet.data[1];
+			key->index = replay->num_requests++;
+
+			/*
+			 *	Replaces any earlier request with the
+			 *	same ID, which didn't get a reply.
+			 */
+			fr_hash_table_replace(outstanding, key);
+			continue;
+		}
+
+		memset(&search, 0, sizeof(search));
+		search.client_ipaddr = packet.dst_ipaddr;
+		search.client_port = packet.dst_port;
+		search.server_ipaddr = packet.src_ipaddr;
+		search.server_port = packet.src_port;
+		search.id = packet.data[1];
+
+		key = fr_hash_table_yank(outstanding, &search);
+		if (!key) continue;
+
+		replay->captured[key->index] = packet.data[0];
+		talloc_free(key);
+	}
+
+	talloc_free(outstanding);
+	talloc_free(in);
+
+	return ret;
+}
+
+/** Copy a captured request, and sign it with our secret
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the request couldn't be signed.
+ */
+static int rc_replay_rewrite(rc_replay_t *replay, rc_replay_packet_t const *packet, uint8_t *out, uint8_t id)
+{
+	char const		*secret = replay->config->secret;
+	char const		*original = secret;
+	rc_replay_client_t	*client, search;
+
+	memcpy(out, packet->data, packet->data_len);
+	out[1] = id;
+
+	search.ipaddr = packet->src_ipaddr;
+	client = fr_hash_table_finddata(replay->clients, &search);
+	if (client) original = client->secret;
+
+	/*
+	 *	User-Password was encrypted with the client's
+	 *	secret.  Decrypt it, and encrypt it with ours.  The
+	 *	Request Authenticator doesn't change.
+	 */
+	if ((out[0] == FR_CODE_ACCESS_REQUEST) && (strcmp(original, secret) != 0)) {
+		uint8_t *p = out + RADIUS_HDR_LEN, *end = out + packet->data_len;
+
+		while ((p + 2) <= end) {
+			char	buffer[256];
+			size_t	len;
+
+			if (p[1] < 2) break;
+			len = p[1] - 2;
+
+			if ((p[0] == FR_USER_PASSWORD) && (len > 0) && (len <= 128) && ((len % AUTH_PASS_LEN) == 0)) {
+				memcpy(buffer, p + 2, len);
+				fr_radius_decode_password(buffer, len, original, out + 4);
+				fr_radius_encode_password(buffer, &len, secret, out + 4);
+				memcpy(p + 2, buffer, len);
+			}
+			p += p[1];
+		}
+	}
+
+	return fr_radius_sign(out, NULL, (uint8_t const *) secret, talloc_array_length(secret) - 1,
+			      &replay->hmac_key);
+}
+
+/** When the next request is due, in our time
+ *
+ */
+static uint64_t rc_replay_due(rc_replay_t *replay)
+{
+	uint64_t ts;
+
+	if (replay->config->speed <= 0) return 0;
+
+	ts = ((uint64_t) replay->packet.ts.tv_sec * 1000000) + replay->packet.ts.tv_usec;
+	if (ts < replay->first) return replay->start;
+
+	return replay->start + (uint64_t) ((ts - replay->first) / replay->config->speed);
+}
+
+/** Send the requests which are due
+ *
+ * As with load generation, the schedule is open-loop.  If no socket
+ * has a free ID, the request is counted as stalled, and not sent.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on error reading the capture.
+ */
+static int rc_replay_send(rc_replay_t *replay, uint64_t now)
+{
+	rc_replay_config_t const *config = replay->config;
+	udp_datagram_t		dg[UDP_BATCH_MAX];
+	uint8_t			id[UDP_BATCH_MAX];
+	rc_replay_socket_t	*sock = &replay->sockets[replay->sock_idx];
+	int			num = 0, sent, i, ret = 0;
+
+	while (replay->have_packet && (rc_replay_due(replay) <= now) && (num < UDP_BATCH_MAX)) {
+		uint8_t		*packet;
+		uint32_t	tries;
+
+		/*
+		 *	This socket has no free ID.  Send what we
+		 *	have, or look for another socket.
+		 */
+		if (sock->slot[sock->next_id].used) {
+			if (num > 0) break;
+
+			for (tries = 1; tries < config->ports; tries++) {
+				replay->sock_idx = (replay->sock_idx + 1) % config->ports;
+				sock = &replay->sockets[replay->sock_idx];
+				if (!sock->slot[sock->next_id].used) break;
+			}
+
+			if (sock->slot[sock->next_id].used) {
+				replay->stats.stalled++;
+				goto next;
+			}
+		}
+
+		packet = replay->send_buffer + (num * MAX_PACKET_LEN);
+		if (rc_replay_rewrite(replay, &replay->packet, packet, sock->next_id) < 0) {
+			replay->stats.invalid++;
+			goto next;
+		}
+		id[num] = sock->next_id++;
+
+		memset(&dg[num], 0, sizeof(dg[num]));
+		dg[num].data = packet;
+		dg[num].data_len = replay->packet.data_len;
+		dg[num].dst_ipaddr = config->server_ipaddr;
+		dg[num].dst_port = config->server_port ? config->server_port : replay->packet.dst_port;
+
+		sock->slot[id[num]].used = true;
+		sock->slot[id[num]].sent = now;
+		sock->slot[id[num]].index = replay->index;
+		memcpy(sock->slot[id[num]].header, packet, RADIUS_HDR_LEN);
+		num++;
+
+	next:
+		replay->index++;
+		ret = rc_replay_read_request(replay->in, &replay->packet);
+		replay->have_packet = (ret > 0);
+	}
+
+	if (num > 0) {
+		/*
+		 *	Datagrams are sent in order, so any which the
+		 *	kernel wouldn't take are at the end of the batch.
+		 */
+		sent = udp_send_batch(sock->fd, dg, num);
+		for (i = sent; i < num; i++) sock->slot[id[i]].used = false;
+
+		replay->stats.sent += sent;
+		replay->stats.dropped += num - sent;
+
+		replay->sock_idx = (replay->sock_idx + 1) % config->ports;
+	}
+
+	return (ret < 0) ? -1 : 0;
+}
+
+/** Compare the code of a reply with the captured one
+ *
+ */
+static void rc_replay_compare(rc_replay_t *replay, rc_replay_slot_t const *slot, uint8_t code)
+{
+	uint8_t captured = replay->captured[slot->index];
+
+	if (captured == code) {
+		replay->stats.same++;
+		return;
+	}
+
+	replay->stats.different++;
+
+	if (do_output) {
+		fprintf(stdout, "(%" PRIu64 ") %s: captured %s, replayed %s\n",
+			slot->index + 1, rc_replay_code_name(slot->header[0]),
+			rc_replay_code_name(captured), rc_replay_code_name(code));
+	}
+}
+
+/** Read replies from a socket, and match them to requests
+ *
+ */
+static void rc_replay_recv(rc_replay_t *replay, rc_replay_socket_t *sock)
+{
+	char const		*secret = replay->config->secret;
+	udp_datagram_t		dg[UDP_BATCH_MAX];
+	int			num, i;
+	uint64_t		now;
+
+	do {
+		for (i = 0; i < UDP_BATCH_MAX; i++) {
+			dg[i].data = replay->recv_buffer + (i * MAX_PACKET_LEN);
+			dg[i].data_len = MAX_PACKET_LEN;
+		}
+
+		num = udp_recv_batch(sock->fd, dg, UDP_BATCH_MAX);
+		if (num <= 0) return;
+
+		now = rc_time_now();
+
+		for (i = 0; i < num; i++) {
+			rc_replay_slot_t	*slot;
+			size_t			len = dg[i].data_len;
+			decode_fail_t		reason;
+
+			if (len < RADIUS_HDR_LEN) {
+				replay->stats.invalid++;
+				continue;
+			}
+
+			slot = &sock->slot[dg[i].data[1]];
+			if (!slot->used) {
+				replay->stats.unexpected++;
+				continue;
+			}
+
+			if (!fr_radius_ok(dg[i].data, &len, false, &reason) ||
+			    (fr_radius_verify(dg[i].data, slot->header, (uint8_t const *) secret,
+					      talloc_array_length(secret) - 1, &replay->hmac_key) < 0)) {
+				replay->stats.invalid++;
+				continue;
+			}
+
+			slot->used = false;
+			replay->stats.received++;
+			rc_histogram_add(&replay->stats.latency, now - slot->sent);
+			rc_replay_compare(replay, slot, dg[i].data[0]);
+		}
+	} while (num == UDP_BATCH_MAX);
+}
+
+/** Count requests which have been waiting longer than the timeout as lost
+ *
+ * @return the number of requests still outstanding.
+ */
+static uint64_t rc_replay_expire(rc_replay_t *replay, uint64_t now, uint64_t timeout)
+{
+	uint32_t	i;
+	int		j;
+	uint64_t	outstanding = 0;
+
+	for (i = 0; i < replay->config->ports; i++) {
+		for (j = 0; j < 256; j++) {
+			rc_replay_slot_t *slot = &replay->sockets[i].slot[j];
+
+			if (!slot->used) continue;
+
+			if ((now - slot->sent) >= timeout) {
+				slot->used = false;
+				replay->stats.lost++;
+				rc_replay_compare(replay, slot, 0);
+				continue;
+			}
+			outstanding++;
+		}
+	}
+
+	return outstanding;
+}
+
+static void rc_replay_stats_print(rc_replay_t const *replay, double elapsed)
+{
+	rc_replay_stats_t const *stats = &replay->stats;
+
+	if (!do_output) return;
+
+	fprintf(stdout, "Replay summary:\n"
+		"\tCaptured      : %" PRIu64 "\n"
+		"\tElapsed       : %.3f s\n"
+		"\tSent          : %" PRIu64 " (%.0f/s)\n"
+		"\tReceived      : %" PRIu64 "\n"
+		"\tLost          : %" PRIu64 "\n"
+		"\tStalled       : %" PRIu64 "\n"
+		"\tDropped       : %" PRIu64 "\n"
+		"\tInvalid       : %" PRIu64 "\n"
+		"\tUnexpected    : %" PRIu64 "\n"
+		"\tSame result   : %" PRIu64 "\n"
+		"\tDifferent     : %" PRIu64 "\n",
+		replay->num_requests, elapsed,
+		stats->sent, elapsed > 0 ? stats->sent / elapsed : 0,
+		stats->received, stats->lost, stats->stalled, stats->dropped,
+		stats->invalid, stats->unexpected, stats->same, stats->different);
+
+	rc_histogram_print(stdout, &stats->latency);
+}
+
+/** Run radclient in pcap replay mode
+ *
+ * @param[in] config	for replay.
+ * @return
+ *	- 0 if every request got the same reply as was captured.
+ *	- 1 if there were differences, or requests were lost.
+ *	- -1 on error.
+ */
+int rc_replay_run(rc_replay_config_t const *config)
+{
+	TALLOC_CTX		*ctx;
+	rc_replay_t		*replay;
+	uint64_t		now, timeout, last_expire;
+	uint32_t		i;
+	int			ret, rcode = -1;
+	bool			failed = false;
+	struct sigaction	act, old_int, old_term;
+
+	do_output = config->do_output;
+
+	ctx = talloc_init("radclient replay");
+	if (!ctx) return -1;
+
+	replay = talloc_zero(ctx, rc_replay_t);
+	if (!replay) {
+	oom:
+		fr_strerror_printf("Out of memory");
+		goto finish;
+	}
+	replay->config = config;
+	fr_hmac_md5_key_init(&replay->hmac_key, (uint8_t const *) config->secret,
+			     talloc_array_length(config->secret) - 1);
+
+	replay->clients = fr_hash_table_create(replay, rc_replay_client_hash, rc_replay_client_cmp, NULL);
+	if (!replay->clients) goto oom;
+
+	if (config->secrets && (rc_replay_secrets_load(replay, config->secrets) < 0)) goto finish;
+
+	if (rc_replay_index(replay, replay) < 0) goto finish;
+
+	replay->sockets = talloc_zero_array(replay, rc_replay_socket_t, config->ports);
+	if (!replay->sockets) goto oom;
+	for (i = 0; i < config->ports; i++) replay->sockets[i].fd = -1;
+
+	replay->pfds = talloc_zero_array(replay, struct pollfd, config->ports);
+	replay->send_buffer = talloc_array(replay, uint8_t, UDP_BATCH_MAX * MAX_PACKET_LEN);
+	replay->recv_buffer = talloc_array(replay, uint8_t, UDP_BATCH_MAX * MAX_PACKET_LEN);
+	if (!replay->pfds || !replay->send_buffer || !replay->recv_buffer) goto oom;
+
+	for (i = 0; i < config->ports; i++) {
+		fr_ipaddr_t	ipaddr = config->client_ipaddr;
+		uint16_t	port = 0;
+		int		fd;
+
+		fd = fr_socket_server_udp(&ipaddr, &port, NULL, true);
+		if (fd < 0) goto finish;
+		replay->sockets[i].fd = fd;
+
+		if (fr_socket_bind(fd, &ipaddr, &port, NULL) < 0) goto finish;
+
+		replay->sockets[i].next_id = fr_rand() & 0xff;
+		replay->pfds[i].fd = fd;
+		replay->pfds[i].events = POLLIN;
+	}
+
+	replay->in = rc_replay_open(replay, config->filename);
+	if (!replay->in) goto finish;
+
+	ret = rc_replay_read_request(replay->in, &replay->packet);
+	if (ret < 0) goto finish;
+	replay->have_packet = (ret > 0);
+	if (replay->have_packet) {
+		replay->first = ((uint64_t) replay->packet.ts.tv_sec * 1000000) + replay->packet.ts.tv_usec;
+	}
+
+	/*
+	 *	The first signal stops sending, the second stops
+	 *	waiting for replies.
+	 */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = rc_replay_signal;
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGINT, &act, &old_int);
+	sigaction(SIGTERM, &act, &old_term);
+
+	timeout = config->timeout * 1000000;
+	replay->start = last_expire = rc_time_now();
+
+	for (;;) {
+		int wait = 0;
+
+		now = rc_time_now();
+
+		if (replay->have_packet && !rc_replay_stop) {
+			uint64_t due;
+
+			if (rc_replay_send(replay, now) < 0) {
+				failed = true;
+				break;
+			}
+
+			/*
+			 *	Wake up at least every 100ms, so
+			 *	that we notice when to stop.
+			 */
+			due = rc_replay_due(replay);
+			if (replay->have_packet && (due > now)) wait = (due - now) / 1000;
+			if (wait > 100) wait = 100;
+		} else {
+			/*
+			 *	Done sending, wait for the
+			 *	outstanding replies.
+			 */
+			if (rc_replay_expire(replay, now, timeout) == 0) break;
+			if (rc_replay_stop > 1) break;
+
+			wait = 1;
+		}
+
+		if (poll(replay->pfds, config->ports, wait) > 0) {
+			for (i = 0; i < config->ports; i++) {
+				if (!(replay->pfds[i].revents & POLLIN)) continue;
+
+				rc_replay_recv(replay, &replay->sockets[i]);
+			}
+		}
+
+		if ((now - last_expire) >= RC_REPLAY_EXPIRE_INTERVAL) {
+			rc_replay_expire(replay, now, timeout);
+			last_expire = now;
+		}
+	}
+
+	/*
+	 *	Anything left over was interrupted.
+	 */
+	rc_replay_expire(replay, UINT64_MAX, 0);
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+
+	rc_replay_stats_print(replay, (rc_time_now() - replay->start) / 1000000.0);
+
+	if (failed) goto finish;
+
+	rcode = ((replay->stats.lost > 0) || (replay->stats.different > 0) ||
+		 (replay->stats.stalled > 0) || (replay->stats.dropped > 0)) ? 1 : 0;
+
+finish:
+	if (replay && replay->sockets) for (i = 0; i < config->ports; i++) {
+		if (replay->sockets[i].fd >= 0) close(replay->sockets[i].fd);
+	}
+	talloc_free(ctx);
+
+	return rcode;
+}
+#else
+int rc_replay_run(UNUSED rc_replay_config_t const *config)
+{
+	fr_strerror_printf("radclient was built without libpcap, so can't replay captures");
+	return -1;
+}
+#endif
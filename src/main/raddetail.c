@@ -0,0 +1,297 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file raddetail.c
+ * @brief Print binary detail files as text.
+ *
+ * @copyright 2026  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/detail.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+static char const *raddb_dir = RADDBDIR;
+static char const *dict_dir = DICTDIR;
+
+char const *radlog_dir = NULL;
+char const *radacct_dir = NULL;
+
+bool log_stripped_names;
+
+/*
+ *	Global, for log.c to use.
+ */
+main_config_t main_config;
+
+static bool check_only = false;
+
+/*
+ *	Print usage message and exit.
+ */
+static void NEVER_RETURNS usage(int status)
+{
+	FILE *output = status ? stderr : stdout;
+
+	fprintf(output, "Usage: raddetail [-c] [-d raddb] [-D dictdir] file ...\n");
+	fprintf(output, "  -c                   Only check the files for damaged records.\n");
+	fprintf(output, "  -d <raddb>           Set the raddb directory (default is %s).\n", RADIUS_DIR);
+	fprintf(output, "  -D <dictdir>         Set the dictionary directory (default is %s).\n", DICTDIR);
+	fprintf(output, "  -h                   Print this help message.\n");
+	fprintf(output, "\n");
+	fprintf(output, "Binary detail files are written by the detail module with \"format = binary\".\n");
+	fprintf(output, "They are printed in the same format as text detail files.\n");
+	exit(status);
+}
+
+/** Print one attribute, made from a packet header field
+ *
+ */
+static void print_header_pair(TALLOC_CTX *ctx, unsigned int attr, fr_ipaddr_t const *ipaddr, uint16_t port)
+{
+	VALUE_PAIR *vp;
+
+	if (ipaddr) {
+		switch (ipaddr->af) {
+		case AF_INET:
+			vp = fr_pair_afrom_num(ctx, 0, attr);
+			if (!vp) return;
+			vp->vp_ipv4addr = ipaddr->addr.v4.s_addr;
+			break;
+
+		case AF_INET6:
+			vp = fr_pair_afrom_num(ctx, 0, (attr == FR_PACKET_SRC_IP_ADDRESS) ?
+					       FR_PACKET_SRC_IPV6_ADDRESS : FR_PACKET_DST_IPV6_ADDRESS);
+			if (!vp) return;
+			memcpy(&vp->vp_ipv6addr, &ipaddr->addr.v6, sizeof(vp->vp_ipv6addr));
+			break;
+
+		default:
+			return;
+		}
+	} else {
+		vp = fr_pair_afrom_num(ctx, 0, attr);
+		if (!vp) return;
+		vp->vp_uint32 = port;
+	}
+
+	vp->type = VT_DATA;
+	vp->op = T_OP_EQ;
+	fr_pair_fprint(stdout, vp);
+	talloc_free(vp);
+}
+
+/** Print a record in the text format written by rlm_detail
+ *
+ */
+static int print_record(char const *filename, uint64_t offset, uint8_t const *data, size_t data_len)
+{
+	TALLOC_CTX		*ctx;
+	fr_detail_record_t	rec;
+	VALUE_PAIR		*vps = NULL, *vp;
+	vp_cursor_t		cursor;
+	time_t			when;
+	char			buffer[128], *nl;
+	int			skipped;
+
+	ctx = talloc_init("raddetail");
+	if (!ctx) return -1;
+
+	skipped = fr_detail_binary_decode(ctx, &rec, &vps, data, data_len);
+	if (skipped < 0) {
+		fr_perror("raddetail: %s: Failed reading record at offset %" PRIu64, filename, offset);
+		talloc_free(ctx);
+		return -1;
+	}
+
+	if (skipped > 0) {
+		fprintf(stderr, "raddetail: %s: Skipped %i attributes in the record at offset %" PRIu64 " "
+			"which don't match the dictionary\n", filename, skipped, offset);
+	}
+
+	if (check_only) {
+		talloc_free(ctx);
+		return 0;
+	}
+
+	when = rec.timestamp.tv_sec;
+	CTIME_R(&when, buffer, sizeof(buffer));
+	nl = strchr(buffer, '\n');
+	if (nl) *nl = '\0';
+
+	printf("%s\n", buffer);
+
+	if (is_radius_code(rec.code)) {
+		printf("\tPacket-Type = %s\n", fr_packet_codes[rec.code]);
+	} else {
+		printf("\tPacket-Type = %u\n", rec.code);
+	}
+
+	print_header_pair(ctx, FR_PACKET_SRC_IP_ADDRESS, &rec.src_ipaddr, 0);
+	print_header_pair(ctx, FR_PACKET_DST_IP_ADDRESS, &rec.dst_ipaddr, 0);
+	print_header_pair(ctx, FR_PACKET_SRC_PORT, NULL, rec.src_port);
+	print_header_pair(ctx, FR_PACKET_DST_PORT, NULL, rec.dst_port);
+
+	for (vp = fr_pair_cursor_init(&cursor, &vps);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		vp->op = T_OP_EQ;
+		fr_pair_fprint(stdout, vp);
+	}
+
+	printf("\tTimestamp = %ld\n\n", (long) rec.timestamp.tv_sec);
+
+	talloc_free(ctx);
+
+	return 0;
+}
+
+/** Print every record in a binary detail file
+ *
+ * @return the number of damaged records, or -1 if the file can't be read.
+ */
+static int print_file(char const *filename)
+{
+	int		fd, damaged = 0;
+	struct stat	st;
+	uint8_t		*map;
+	size_t		offset = 0;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "raddetail: Failed opening %s: %s\n", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "raddetail: Failed to stat %s: %s\n", filename, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "raddetail: Failed mapping %s: %s\n", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	while (offset < (size_t) st.st_size) {
+		ssize_t slen;
+
+		slen = fr_detail_binary_check(map + offset, st.st_size - offset);
+		if (slen > 0) {
+			if (print_record(filename, offset, map + offset, slen) < 0) damaged++;
+			offset += slen;
+			continue;
+		}
+
+		damaged++;
+
+		if (slen == 0) {
+			fprintf(stderr, "raddetail: %s: Truncated record at offset %zu\n", filename, offset);
+			break;
+		}
+
+		fr_perror("raddetail: %s: Damaged record at offset %zu", filename, offset);
+		offset += 1 + fr_detail_binary_resync(map + offset + 1, st.st_size - offset - 1);
+	}
+
+	munmap(map, st.st_size);
+
+	return damaged;
+}
+
+int main(int argc, char **argv)
+{
+	int		c, i, rcode = EXIT_SUCCESS;
+	fr_dict_t	*dict = NULL;
+
+	raddb_dir = RADIUS_DIR;
+
+#ifndef NDEBUG
+	if (fr_fault_setup(getenv("PANIC_ACTION"), argv[0]) < 0) {
+		fr_perror("raddetail");
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	talloc_set_log_stderr();
+
+	while ((c = getopt(argc, argv, "cd:D:h")) != EOF) switch (c) {
+		case 'c':
+			check_only = true;
+			break;
+
+		case 'd':
+			raddb_dir = optarg;
+			break;
+
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'h':
+			usage(EXIT_SUCCESS);	/* never returns */
+
+		default:
+			usage(EXIT_FAILURE);	/* never returns */
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1) usage(EXIT_FAILURE);
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) {
+		fr_perror("raddetail");
+		return EXIT_FAILURE;
+	}
+
+	if (fr_dict_from_file(NULL, &dict, dict_dir, FR_DICTIONARY_FILE, "radius") < 0) {
+		fr_perror("raddetail");
+		return EXIT_FAILURE;
+	}
+
+	if (fr_dict_read(dict, raddb_dir, FR_DICTIONARY_FILE) == -1) {
+		fr_perror("raddetail");
+		return EXIT_FAILURE;
+	}
+	fr_strerror();	/* Clear the error buffer */
+
+	for (i = 0; i < argc; i++) {
+		if (print_file(argv[i]) != 0) rcode = EXIT_FAILURE;
+	}
+
+	fflush(stdout);
+
+	return rcode;
+}
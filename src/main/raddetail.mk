@@ -0,0 +1,5 @@
+TARGET		:= raddetail
+SOURCES		:= raddetail.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-radius.a libfreeradius-server.a
+TGT_LDLIBS	:= $(LIBS)
@@ -34,6 +34,8 @@ RCSID("$Id$")
 #include <freeradius-devel/state.h>
 #include <freeradius-devel/map_proc.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/startup_trace.h>
+#include <freeradius-devel/io/trace.h>
 
 #include <sys/file.h>
 
@@ -108,7 +110,11 @@ static int talloc_config_set(main_config_t *config)
 	}
 
 	if (!config->talloc_memory_limit && !config->talloc_memory_report) {
-		talloc_disable_null_tracking();
+		/*
+		 *	Startup tracing needs it to measure memory,
+		 *	and turns it off when it's done.
+		 */
+		if (!fr_startup_trace_enabled()) talloc_disable_null_tracking();
 		return 0;
 	}
 
@@ -140,7 +146,9 @@ int main(int argc, char *argv[])
 	bool		display_version = false;
 	int		from_child[2] = {-1, -1};
 	char		*p;
+	char const	*startup_trace = NULL;
 	fr_schedule_t	*sc = NULL;
+	fr_startup_phase_t *trace;
 
 	/*
 	 *	Setup talloc callbacks so we get useful errors
@@ -203,8 +211,12 @@ int main(int argc, char *argv[])
 	}
 
 	/*  Process the options.  */
-	while ((argval = getopt(argc, argv, "Cd:D:fhi:l:L:Mn:p:PstTvxX")) != EOF) {
+	while ((argval = getopt(argc, argv, "c:Cd:D:fhi:l:L:Mn:p:PsS:tTvxX")) != EOF) {
 		switch (argval) {
+		case 'c':	/* Cache the parsed config */
+			main_config.config_cache = talloc_typed_strdup(autofree, optarg);
+			break;
+
 		case 'C':
 			check_config = true;
 			main_config.spawn_workers = false;
@@ -279,6 +291,10 @@ int main(int argc, char *argv[])
 			main_config.daemonize = false;
 			break;
 
+		case 'S':	/* Trace startup phases */
+			startup_trace = optarg;
+			break;
+
 		case 't':	/* no child threads */
 			main_config.spawn_workers = false;
 			break;
@@ -345,6 +361,14 @@ int main(int argc, char *argv[])
 		fr_exit(EXIT_FAILURE);
 	}
 
+	/*
+	 *  Start tracing before the dictionaries are loaded.
+	 */
+	if (startup_trace && (fr_startup_trace_init(startup_trace) < 0)) {
+		fprintf(stderr, "%s: Failed initialising startup trace\n", main_config.name);
+		fr_exit(EXIT_FAILURE);
+	}
+
 	/*
 	 *  Initialising OpenSSL once, here, is safer than having individual modules do it.
 	 *  Must be called before display_version to ensure relevant engines are loaded.
@@ -526,6 +550,12 @@ int main(int argc, char *argv[])
 	 */
 	radius_pid = getpid();
 
+	/*
+	 *  Start the process which runs triggers, and other programs
+	 *  we don't wait for, while the server is still small.
+	 */
+	if (!check_config && (radius_exec_launcher_start() < 0)) fr_exit(EXIT_FAILURE);
+
 	/*
 	 *	Parse the thread pool configuration.
 	 */
@@ -536,7 +566,18 @@ int main(int argc, char *argv[])
 	 *	before loading the modules.  Some modules need those
 	 *	to be defined.
 	 */
+	trace = fr_startup_trace_start("virtual_servers.bootstrap", NULL);
 	if (virtual_servers_bootstrap(main_config.config) < 0) exit(EXIT_FAILURE);
+	fr_startup_trace_stop(trace);
+
+#ifdef WITH_TLS
+	/*
+	 *	Start the crypto threads before the modules create
+	 *	their TLS contexts, so that the private keys can be
+	 *	set up to use them.
+	 */
+	if (!check_config && (tls_async_init(main_config.num_crypto) < 0)) exit(EXIT_FAILURE);
+#endif
 
 	/*
 	 *	Bootstrap the modules.  This links to them, and runs
@@ -544,18 +585,35 @@ int main(int argc, char *argv[])
 	 *
 	 *	After this step, all dynamic attributes, xlats, etc. are defined.
 	 */
+	trace = fr_startup_trace_start("modules.bootstrap", NULL);
 	if (modules_bootstrap(main_config.config) < 0) exit(EXIT_FAILURE);
+	fr_startup_trace_stop(trace);
 
 	/*
 	 *	Call the module's initialisation methods.  These create
 	 *	connection pools and open connections to external resources.
 	 */
+	trace = fr_startup_trace_start("modules.instantiate", NULL);
 	if (modules_instantiate(main_config.config) < 0) exit(EXIT_FAILURE);
+	fr_startup_trace_stop(trace);
 
 	/*
 	 *	And then load the virtual servers.
 	 */
+	trace = fr_startup_trace_start("virtual_servers.instantiate", NULL);
 	if (virtual_servers_instantiate(main_config.config) < 0) exit(EXIT_FAILURE);
+	fr_startup_trace_stop(trace);
+
+	/*
+	 *	Other threads are about to be started, and the talloc
+	 *	tree can't be walked while they're allocating memory.
+	 */
+	if (fr_startup_trace_enabled()) {
+		fr_startup_trace_memory_stop();
+		if (!main_config.talloc_memory_limit && !main_config.talloc_memory_report) {
+			talloc_disable_null_tracking();
+		}
+	}
 
 	/*
 	 *	Initialise the SNMP stats structures
@@ -582,6 +640,27 @@ int main(int argc, char *argv[])
 		fr_exit(EXIT_FAILURE);
 	}
 
+	/*
+	 *  Start the log writer.  This has to be done post-fork, as
+	 *  threads aren't inherited by the child process.
+	 */
+	if (!check_config && main_config.log_async &&
+	    (fr_log_async_start(main_config.log_async_ring_size, main_config.log_async_block) < 0)) {
+		PERROR("Failed starting log writer");
+		fr_exit(EXIT_FAILURE);
+	}
+
+	/*
+	 *  Start the trace exporter.  This has to be done post-fork,
+	 *  and before the network threads start sampling requests.
+	 */
+	if (!check_config && main_config.trace_endpoint && main_config.trace_sample_rate &&
+	    (fr_trace_start(main_config.trace_endpoint, main_config.trace_service_name,
+			    main_config.trace_sample_rate) < 0)) {
+		PERROR("Failed starting trace exporter");
+		fr_exit(EXIT_FAILURE);
+	}
+
 	/*
 	 *	If this isn't just a config check, AND we have new
 	 *	async listeners, then we open the sockets.
@@ -591,6 +670,9 @@ int main(int argc, char *argv[])
 		int workers = 4;
 		fr_event_list_t *el = NULL;
 
+		if (main_config.schedule->num_networks) networks = main_config.schedule->num_networks;
+		if (main_config.schedule->num_workers) workers = main_config.schedule->num_workers;
+
 		if (!main_config.spawn_workers) {
 			networks = 0;
 			workers = 0;
@@ -599,11 +681,13 @@ int main(int argc, char *argv[])
 
 		sc = fr_schedule_create(NULL, el, &default_log, networks, workers,
 					(fr_schedule_thread_instantiate_t) modules_thread_instantiate,
-					main_config.config);
+					main_config.config, main_config.schedule);
 		if (!sc) {
 			exit(EXIT_FAILURE);
 		}
 
+		main_config.scheduler = sc;
+
 		if (virtual_servers_open(sc) < 0) exit(EXIT_FAILURE);
 	}
 
@@ -613,6 +697,11 @@ int main(int argc, char *argv[])
 	 */
 	if (main_config.spawn_workers && (thread_pool_init() < 0)) exit(EXIT_FAILURE);
 
+	/*
+	 *	Everything which is traced has been done.
+	 */
+	(void) fr_startup_trace_report();
+
 	event_loop_started = true;
 
 #ifndef NDEBUG
@@ -678,6 +767,8 @@ int main(int argc, char *argv[])
 	radius_stats_init(0);
 #endif
 
+	if (metrics_open(process_global_event_list(EVENT_CORRAL_MAIN)) < 0) fr_exit(EXIT_FAILURE);
+
 	/*
 	 *  Write the PID after we've forked, so that we write the correct one.
 	 */
@@ -731,7 +822,7 @@ int main(int argc, char *argv[])
 #ifdef WITH_STATS
 		radius_stats_init(1);
 #endif
-		main_config_hup();
+		main_config_hup(process_global_event_list(EVENT_CORRAL_MAIN));
 	}
 
 	if (status < 0) {
@@ -788,6 +879,22 @@ cleanup:
 	 */
 	modules_free();
 
+	/*
+	 *	Nothing else will be started.
+	 */
+	radius_exec_launcher_stop();
+
+	/*
+	 *	Send any queued traces.
+	 */
+	fr_trace_stop();
+
+	/*
+	 *	Write out any queued log messages.  Anything logged
+	 *	after this is written directly.
+	 */
+	fr_log_async_stop();
+
 	/*
 	 *	The only xlats remaining are the ones registered by the server core.
 	 */
@@ -804,6 +911,11 @@ cleanup:
 	 */
 	main_config_free();
 
+#ifdef WITH_TLS
+	tls_async_free();		/* Stop the crypto threads */
+	tls_engine_free();		/* Release hardware crypto engines */
+#endif
+
 #ifdef WIN32
 	WSACleanup();
 #endif
@@ -834,6 +946,8 @@ static void NEVER_RETURNS usage(int status)
 
 	fprintf(output, "Usage: %s [options]\n", main_config.name);
 	fprintf(output, "Options:\n");
+	fprintf(output, "  -c <file>     Cache the parsed configuration in <file>, and read it from there when\n");
+	fprintf(output, "                no configuration file has changed.\n");
 	fprintf(output, "  -C            Check configuration and exit.\n");
 	fprintf(stderr, "  -d <raddb>    Set configuration directory (defaults to " RADDBDIR ").\n");
 	fprintf(stderr, "  -D <dictdir>  Set main dictionary directory (defaults to " DICTDIR ").\n");
@@ -849,6 +963,7 @@ static void NEVER_RETURNS usage(int status)
 #endif
 	fprintf(output, "  -P            Always write out PID, even with -f.\n");
 	fprintf(output, "  -s            Do not spawn child processes to handle requests (same as -ft).\n");
+	fprintf(output, "  -S <file>     Write the time and memory used by each phase of startup to <file>.\n");
 	fprintf(output, "  -t            Disable threads.\n");
 	fprintf(output, "  -T            Prepend timestamps to  log messages.\n");
 	fprintf(output, "  -v            Print server version information.\n");
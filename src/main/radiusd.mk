@@ -6,6 +6,7 @@ SOURCES := acct.c \
     crypt.c \
     files.c \
     mainconfig.c \
+    metrics.c \
     modules.c \
     radiusd.c \
     state.c \
@@ -41,24 +41,41 @@ RCSID("$Id$")
 #  include <collectd/client.h>
 #endif
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 #define RS_ASSERT(_x) if (!(_x) && !fr_cond_assert(_x)) exit(1)
 
 static rs_t *conf;
 static struct timeval start_pcap = {0, 0};
-static char timestr[50];
+static _Thread_local char timestr[50];
 
-static rbtree_t *request_tree = NULL;
-static rbtree_t *link_tree = NULL;
-static fr_event_list_t *events;
+/*
+ *	When capturing with multiple threads, each thread links the
+ *	packets it sees, and has its own copy of these.
+ */
+static _Thread_local rbtree_t *request_tree = NULL;
+static _Thread_local rbtree_t *link_tree = NULL;
+static _Thread_local fr_event_list_t *events;
+static _Thread_local TALLOC_CTX *request_ctx;	//!< What requests are allocated in.
+static _Thread_local rs_thread_t *thread;	//!< The current capture thread, NULL in the main thread.
+static _Thread_local uint64_t packets_seen;	//!< Capture threads interleave their counts,
+						//!< so packet IDs are unique.
 static bool cleanup;
 
+static rs_thread_t *threads;			//!< Capture threads, NULL if capturing in the main thread.
+static atomic_uint_fast64_t captured = ATOMIC_VAR_INIT(0);	//!< Packets captured by all threads.
+
 static int self_pipe[2] = {-1, -1};		//!< Signals from sig handlers
 
 typedef int (*rbcmp)(void const *, void const *);
 
 static char const *radsniff_version = RADIUSD_VERSION_STRING_BUILD("radsniff");
 
-static int rs_useful_codes[] = {
+static int const rs_useful_codes[] = {
 	FR_CODE_ACCESS_REQUEST,			//!< RFC2865 - Authentication request
 	FR_CODE_ACCESS_ACCEPT,			//!< RFC2865 - Access-Accept
 	FR_CODE_ACCESS_REJECT,			//!< RFC2865 - Access-Reject
@@ -86,6 +103,7 @@ static const FR_NAME_NUMBER rs_events[] = {
 };
 
 static void NEVER_RETURNS usage(int status);
+static void rs_signal_self(int sig);
 
 /** Fork and kill the parent process, writing out our PID
  *
@@ -519,11 +537,84 @@ static int rs_check_pcap_drop(fr_pcap_t *in)
 	return ret;
 }
 
+static double const rs_percentiles[RS_PERCENTILES] = { 0.5, 0.9, 0.99, 0.999 };
+
+/** Record a latency in a histogram
+ *
+ * Values below 2^RS_HISTOGRAM_SUB_BITS have a bucket each.  Above that, each
+ * power of two is split into 2^RS_HISTOGRAM_SUB_BITS buckets of equal width.
+ *
+ * @param h		to record the latency in.
+ * @param usec		latency in microseconds.
+ */
+static void rs_histogram_add(rs_histogram_t *h, uint64_t usec)
+{
+	unsigned int	msb, shift, i;
+
+	if (usec < (1 << RS_HISTOGRAM_SUB_BITS)) {
+		i = usec;
+	} else {
+		if (usec >= ((uint64_t) 1 << RS_HISTOGRAM_MAX_BITS)) usec = ((uint64_t) 1 << RS_HISTOGRAM_MAX_BITS) - 1;
+
+		for (msb = RS_HISTOGRAM_SUB_BITS; (usec >> (msb + 1)) != 0; msb++);
+
+		shift = msb - RS_HISTOGRAM_SUB_BITS;
+		i = ((shift + 1) << RS_HISTOGRAM_SUB_BITS) +
+		    ((usec >> shift) & ((1 << RS_HISTOGRAM_SUB_BITS) - 1));
+	}
+
+	h->bucket[i]++;
+	h->count++;
+}
+
+/** Return the value at a percentile of a histogram
+ *
+ * @param h		to read.
+ * @param p		percentile, as a fraction.
+ * @return the middle of the bucket containing the percentile, in milliseconds,
+ *	or NaN if the histogram is empty.
+ */
+static double rs_histogram_percentile(rs_histogram_t const *h, double p)
+{
+	uint64_t	target, seen = 0;
+	unsigned int	i, shift;
+	double		low, width;
+
+	if (!h->count) return strtod("NAN()", (char **) NULL);
+
+	target = ceil(p * h->count);
+	if (!target) target = 1;
+
+	for (i = 0; i < RS_HISTOGRAM_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= target) break;
+	}
+	if (i == RS_HISTOGRAM_BUCKETS) i--;
+
+	if (i < (1 << RS_HISTOGRAM_SUB_BITS)) {
+		low = i;
+		width = 1;
+	} else {
+		shift = (i >> RS_HISTOGRAM_SUB_BITS) - 1;
+		low = (double) (((1 << RS_HISTOGRAM_SUB_BITS) + (i & ((1 << RS_HISTOGRAM_SUB_BITS) - 1))) << shift);
+		width = (double) (1 << shift);
+	}
+
+	return (low + (width / 2)) / 1000;
+}
+
 /** Update smoothed average
  *
  */
 static void rs_stats_process_latency(rs_latency_t *stats)
 {
+	int i;
+
+	for (i = 0; i < RS_PERCENTILES; i++) {
+		stats->interval.latency_percentile[i] = rs_histogram_percentile(&stats->interval.histogram,
+										 rs_percentiles[i]);
+	}
+
 	/*
 	 *	If we didn't link any packets during this interval, we don't have a value to return.
 	 *	returning 0 is misleading as it would be like saying the latency had dropped to 0.
@@ -572,6 +663,13 @@ static void rs_stats_process_counters(rs_latency_t *stats)
 	stats->interval.reused = ((long double) stats->interval.reused_total) / conf->stats.interval;
 	stats->interval.lost = ((long double) stats->interval.lost_total) / conf->stats.interval;
 
+	stats->total.received += stats->interval.received_total;
+	stats->total.linked += stats->interval.linked_total;
+	stats->total.unlinked += stats->interval.unlinked_total;
+	stats->total.reused += stats->interval.reused_total;
+	stats->total.lost += stats->interval.lost_total;
+	stats->total.latency += stats->interval.latency_total;
+
 	for (i = 0; i < RS_RETRANSMIT_MAX; i++) {
 		stats->interval.rt[i] = ((long double) stats->interval.rt_total[i]) / conf->stats.interval;
 	}
@@ -601,6 +699,10 @@ static void rs_stats_print_code_fancy(rs_latency_t *stats, FR_CODE code)
 		INFO("\tLow       : %.3lfms", stats->interval.latency_low);
 		INFO("\tAverage   : %.3lfms", stats->interval.latency_average);
 		INFO("\tMA        : %.3lfms", stats->latency_smoothed);
+		INFO("\tp50       : %.3lfms", stats->interval.latency_percentile[0]);
+		INFO("\tp90       : %.3lfms", stats->interval.latency_percentile[1]);
+		INFO("\tp99       : %.3lfms", stats->interval.latency_percentile[2]);
+		INFO("\tp999      : %.3lfms", stats->interval.latency_percentile[3]);
 	}
 
 	if (have_rt || stats->interval.lost || stats->interval.reused) {
@@ -783,6 +885,173 @@ static void rs_stats_print_csv(rs_update_t *this, rs_stats_t *stats, UNUSED stru
 	fprintf(stdout , "%s\n", buffer);
 }
 
+static uint32_t rs_peer_hash(void const *data)
+{
+	rs_peer_t const	*peer = data;
+	uint32_t	hash;
+
+	hash = fr_hash(&peer->type, sizeof(peer->type));
+	hash = fr_hash_update(&peer->code, sizeof(peer->code), hash);
+	if (peer->ipaddr.af == AF_INET) {
+		return fr_hash_update(&peer->ipaddr.addr.v4, sizeof(peer->ipaddr.addr.v4), hash);
+	}
+	return fr_hash_update(&peer->ipaddr.addr.v6, sizeof(peer->ipaddr.addr.v6), hash);
+}
+
+static int rs_peer_cmp(void const *one, void const *two)
+{
+	rs_peer_t const *a = one;
+	rs_peer_t const *b = two;
+
+	if (a->type != b->type) return (int) a->type - (int) b->type;
+	if (a->code != b->code) return (int) a->code - (int) b->code;
+
+	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+}
+
+/** Find the stats for a NAS or home server, creating them if they don't exist
+ *
+ * @return
+ *	- The peer.
+ *	- NULL if we're not keeping peer stats, or we're already tracking too many peers.
+ */
+static rs_peer_t *rs_stats_peer_find(rs_stats_t *stats, rs_peer_type_t type, fr_ipaddr_t const *ipaddr, FR_CODE code)
+{
+	rs_peer_t	find, *peer;
+
+	if (!stats->peers) return NULL;
+
+	memset(&find, 0, sizeof(find));
+	find.type = type;
+	find.ipaddr = *ipaddr;
+	find.code = code;
+
+	peer = fr_hash_table_finddata(stats->peers, &find);
+	if (peer) return peer;
+
+	if (fr_hash_table_num_elements(stats->peers) >= RS_PEERS_MAX) return NULL;
+
+	peer = talloc_zero(stats->peers, rs_peer_t);
+	if (!peer) return NULL;
+
+	peer->type = type;
+	peer->ipaddr = *ipaddr;
+	peer->code = code;
+
+	if (!fr_hash_table_insert(stats->peers, peer)) {
+		talloc_free(peer);
+		return NULL;
+	}
+
+	return peer;
+}
+
+/** Add the interval counters from one set of latency stats to another, and clear them
+ *
+ * @param a	stats to add to.
+ * @param b	stats to add, and clear.
+ */
+static void rs_latency_merge(rs_latency_t *a, rs_latency_t *b)
+{
+	size_t j;
+
+	a->interval.received_total += b->interval.received_total;
+	a->interval.linked_total += b->interval.linked_total;
+	a->interval.unlinked_total += b->interval.unlinked_total;
+	a->interval.reused_total += b->interval.reused_total;
+	a->interval.lost_total += b->interval.lost_total;
+	for (j = 0; j <= RS_RETRANSMIT_MAX; j++) a->interval.rt_total[j] += b->interval.rt_total[j];
+
+	a->interval.latency_total += b->interval.latency_total;
+	if (b->interval.latency_high > a->interval.latency_high) {
+		a->interval.latency_high = b->interval.latency_high;
+	}
+	if (b->interval.latency_low &&
+	    (!a->interval.latency_low || (b->interval.latency_low < a->interval.latency_low))) {
+		a->interval.latency_low = b->interval.latency_low;
+	}
+
+	a->interval.histogram.count += b->interval.histogram.count;
+	for (j = 0; j < RS_HISTOGRAM_BUCKETS; j++) {
+		a->interval.histogram.bucket[j] += b->interval.histogram.bucket[j];
+	}
+
+	memset(&b->interval, 0, sizeof(b->interval));
+}
+
+static int _rs_peer_merge(void *ctx, void *data)
+{
+	rs_stats_t	*to = ctx;
+	rs_peer_t	*peer = data, *found;
+
+	if (!peer->stats.interval.linked_total) return 0;
+
+	found = rs_stats_peer_find(to, peer->type, &peer->ipaddr, peer->code);
+	if (found) {
+		rs_latency_merge(&found->stats, &peer->stats);
+	} else {
+		memset(&peer->stats.interval, 0, sizeof(peer->stats.interval));
+	}
+
+	return 0;
+}
+
+/** Add the interval counters from one set of stats to another, and clear them
+ *
+ * @param to	stats to add to.
+ * @param from	stats to add, and clear.
+ */
+static void rs_stats_merge(rs_stats_t *to, rs_stats_t *from)
+{
+	size_t i;
+
+	for (i = 0; i < (sizeof(rs_useful_codes) / sizeof(*rs_useful_codes)); i++) {
+		rs_latency_merge(&to->exchange[rs_useful_codes[i]], &from->exchange[rs_useful_codes[i]]);
+	}
+
+	if (from->peers) fr_hash_table_walk(from->peers, _rs_peer_merge, to);
+}
+
+/** Check a list of pcap handles for drops
+ *
+ * @param in list of pcap handles to check.
+ * @return
+ *	- 0 No drops.
+ *	- <0 if any of the handles dropped packets, or couldn't be checked.
+ */
+static int rs_check_pcap_drops(fr_pcap_t *in)
+{
+	fr_pcap_t	*in_p;
+	int		ret = 0;
+
+	for (in_p = in;
+	     in_p;
+	     in_p = in_p->next) {
+		if (rs_check_pcap_drop(in_p) < 0) ret = -1;
+	}
+
+	return ret;
+}
+
+static int _rs_peer_process(UNUSED void *ctx, void *data)
+{
+	rs_peer_t *peer = data;
+
+	rs_stats_process_latency(&peer->stats);
+	rs_stats_process_counters(&peer->stats);
+
+	return 0;
+}
+
+static int _rs_peer_clear(UNUSED void *ctx, void *data)
+{
+	rs_peer_t *peer = data;
+
+	memset(&peer->stats.interval, 0, sizeof(peer->stats.interval));
+
+	return 0;
+}
+
 /** Process stats for a single interval
  *
  */
@@ -790,9 +1059,9 @@ static void rs_stats_process(fr_event_list_t *el, struct timeval *now, void *ctx
 {
 	size_t		i;
 	size_t		rs_codes_len = (sizeof(rs_useful_codes) / sizeof(*rs_useful_codes));
-	fr_pcap_t	*in_p;
 	rs_update_t	*this = ctx;
 	rs_stats_t	*stats = this->stats;
+	bool		dropped;
 
 	if (!this->done_header) {
 		if (this->head) this->head(this);
@@ -801,15 +1070,30 @@ static void rs_stats_process(fr_event_list_t *el, struct timeval *now, void *ctx
 
 	stats->intervals++;
 
-	for (in_p = this->in;
-	     in_p;
-	     in_p = in_p->next) {
-		if (rs_check_pcap_drop(in_p) < 0) {
-			ERROR("Muting stats for the next %i milliseconds", conf->stats.timeout);
+	if (threads) {
+		int j;
 
-			rs_tv_add_ms(now, conf->stats.timeout, &stats->quiet);
-			goto clear;
+		/*
+		 *	Collect the stats from each of the capture
+		 *	threads.  The lock also stops the thread reading
+		 *	from its handles while we check them for drops.
+		 */
+		dropped = false;
+		for (j = 0; j < conf->threads; j++) {
+			pthread_mutex_lock(&threads[j].mutex);
+			if (rs_check_pcap_drops(threads[j].in) < 0) dropped = true;
+			rs_stats_merge(stats, threads[j].stats);
+			pthread_mutex_unlock(&threads[j].mutex);
 		}
+	} else {
+		dropped = (rs_check_pcap_drops(this->in) < 0);
+	}
+
+	if (dropped) {
+		ERROR("Muting stats for the next %i milliseconds", conf->stats.timeout);
+
+		rs_tv_add_ms(now, conf->stats.timeout, &stats->quiet);
+		goto clear;
 	}
 
 	/*
@@ -822,6 +1106,7 @@ static void rs_stats_process(fr_event_list_t *el, struct timeval *now, void *ctx
 		rs_stats_process_latency(&stats->exchange[rs_useful_codes[i]]);
 		rs_stats_process_counters(&stats->exchange[rs_useful_codes[i]]);
 	}
+	if (stats->peers) fr_hash_table_walk(stats->peers, _rs_peer_process, NULL);
 
 	if (this->body) this->body(this, stats, now);
 
@@ -835,6 +1120,10 @@ static void rs_stats_process(fr_event_list_t *el, struct timeval *now, void *ctx
 	}
 #endif
 
+	if (conf->metrics.file || conf->metrics.listen) {
+		rs_stats_openmetrics_do_stats(conf, stats, rs_useful_codes, rs_codes_len);
+	}
+
 clear:
 	/*
 	 *	Rinse and repeat...
@@ -843,6 +1132,7 @@ clear:
 		memset(&stats->exchange[rs_useful_codes[i]].interval, 0,
 		       sizeof(stats->exchange[rs_useful_codes[i]].interval));
 	}
+	if (stats->peers) fr_hash_table_walk(stats->peers, _rs_peer_clear, NULL);
 
 	{
 		static fr_event_timer_t const *event;
@@ -876,6 +1166,21 @@ static void rs_stats_update_latency(rs_latency_t *stats, struct timeval *latency
 	}
 	stats->interval.latency_total += lint;
 
+	rs_histogram_add(&stats->interval.histogram, (latency->tv_sec * (uint64_t) 1000000) + latency->tv_usec);
+}
+
+/** Update latency statistics for the NAS and home server of a request
+ *
+ */
+static void rs_stats_update_peers(rs_stats_t *stats, RADIUS_PACKET const *request, struct timeval *latency)
+{
+	rs_peer_t *peer;
+
+	peer = rs_stats_peer_find(stats, RS_PEER_NAS, &request->src_ipaddr, request->code);
+	if (peer) rs_stats_update_latency(&peer->stats, latency);
+
+	peer = rs_stats_peer_find(stats, RS_PEER_HOME_SERVER, &request->dst_ipaddr, request->code);
+	if (peer) rs_stats_update_latency(&peer->stats, latency);
 }
 
 static int rs_install_stats_processor(rs_stats_t *stats, fr_event_list_t *el,
@@ -920,8 +1225,7 @@ static int rs_install_stats_processor(rs_stats_t *stats, fr_event_list_t *el,
 		rs_tv_add_ms(now, conf->stats.timeout, &(stats->quiet));
 	}
 
-	if (fr_event_timer_insert(NULL, events, (void *) &update,
-				  now, rs_stats_process, &event) < 0) {
+	if (fr_event_timer_insert(NULL, el, &event, now, rs_stats_process, &update) < 0) {
 		ERROR("Failed inserting stats event");
 		return -1;
 	}
@@ -1068,7 +1372,10 @@ static void _rs_event(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, vo
 {
 	rs_request_t *request = talloc_get_type_abort(ctx, rs_request_t);
 	request->event = NULL;
+
+	if (thread) pthread_mutex_lock(&thread->mutex);
 	rs_packet_cleanup(request);
+	if (thread) pthread_mutex_unlock(&thread->mutex);
 }
 
 /** Wrapper around fr_packet_cmp to strip off the outer request struct
@@ -1194,7 +1501,6 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	bool			response;		/* Was it a response code */
 
 	decode_fail_t		reason;			/* Why we failed decoding the packet */
-	static uint64_t		captured = 0;
 
 	rs_status_t		status = RS_NORMAL;	/* Any special conditions (RTX, Unlinked, ID-Reused) */
 	RADIUS_PACKET		*current;		/* Current packet were processing */
@@ -1299,7 +1605,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	 *	recover once some requests timeout, so make an effort to deal
 	 *	with allocation failures gracefully.
 	 */
-	current = fr_radius_alloc(conf, false);
+	current = fr_radius_alloc(request_ctx, false);
 	if (!current) {
 		REDEBUG("Failed allocating memory to hold decoded packet");
 		rs_tv_add_ms(&header->ts, conf->stats.timeout, &stats->quiet);
@@ -1616,7 +1922,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 *	...nope it's a new request.
 		 */
 		} else {
-			original = talloc_zero(conf, rs_request_t);
+			original = talloc_zero(request_ctx, rs_request_t);
 			talloc_set_destructor(original, _request_free);
 
 			original->id = count;
@@ -1715,6 +2021,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 */
 		rs_stats_update_latency(&stats->exchange[current->code], &latency);
 		rs_stats_update_latency(&stats->exchange[original->expect->code], &latency);
+		rs_stats_update_peers(stats, original->packet, &latency);
 
 		/*
 		 *	Were filtering on response, now print out the full data from the request
@@ -1752,19 +2059,30 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		fr_radius_free(&current);
 	}
 
-	captured++;
 	/*
 	 *	We've hit our capture limit, break out of the event loop
 	 */
-	if ((conf->limit > 0) && (captured >= conf->limit)) {
-		INFO("Captured %" PRIu64 " packets, exiting...", captured);
-		fr_event_loop_exit(events, 1);
+	if (conf->limit > 0) {
+		uint64_t total;
+
+		total = atomic_fetch_add_explicit(&captured, 1, memory_order_relaxed) + 1;
+		if (total == conf->limit) {
+			INFO("Captured %" PRIu64 " packets, exiting...", total);
+
+			/*
+			 *	The main thread stops the capture threads
+			 */
+			if (thread) {
+				rs_signal_self(SIGTERM);
+			} else {
+				fr_event_loop_exit(events, 1);
+			}
+		}
 	}
 }
 
 static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *ctx)
 {
-	static uint64_t	count = 0;	/* Packets seen */
 	rs_event_t	*event = ctx;
 	pcap_t		*handle = event->in->handle;
 
@@ -1815,9 +2133,9 @@ static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *c
 			do {
 				now = header->ts;
 			} while (fr_event_timer_run(el, &now) == 1);
-			count++;
+			packets_seen++;
 
-			rs_packet_process(count, event, header, data);
+			rs_packet_process(packets_seen, event, header, data);
 			total++;
 		}
 		return;
@@ -1827,20 +2145,22 @@ static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *c
 	 *	Consume multiple packets from the capture buffer.
 	 *	We occasionally need to yield to allow events to run.
 	 */
+	if (thread) pthread_mutex_lock(&thread->mutex);
 	for (i = 0; i < RS_FORCE_YIELD; i++) {
 		ret = pcap_next_ex(handle, &header, &data);
 		if (ret == 0) {
 			/* No more packets available at this time */
-			return;
+			break;
 		}
 		if (ret < 0) {
 			ERROR("Error requesting next packet, got (%i): %s", ret, pcap_geterr(handle));
-			return;
+			break;
 		}
 
-		count++;
-		rs_packet_process(count, event, header, data);
+		packets_seen += conf->threads;
+		rs_packet_process(packets_seen, event, header, data);
 	}
+	if (thread) pthread_mutex_unlock(&thread->mutex);
 }
 
 static int  _rs_event_status(UNUSED void *ctx, struct timeval *wake)
@@ -2087,6 +2407,185 @@ fr_event_list_t *list, int fd, int UNUSED flags, UNUSED void *ctx)
 	}
 }
 
+/** Exit a capture thread's event loop
+ *
+ */
+static void rs_thread_stop(fr_event_list_t *el, UNUSED int fd, UNUSED int flags, UNUSED void *ctx)
+{
+	fr_event_loop_exit(el, 1);
+}
+
+/** Capture packets in a thread, until the main thread tells us to stop
+ *
+ */
+static void *rs_thread_main(void *arg)
+{
+	rs_thread_t	*this = arg;
+	sigset_t	sigset;
+
+	/*
+	 *	Signals are handled by the main thread
+	 */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	thread = this;
+	events = this->el;
+	request_tree = this->request_tree;
+	link_tree = this->link_tree;
+	request_ctx = this->ctx;
+	packets_seen = this->id;
+
+	fr_event_loop(events);
+
+	/*
+	 *	Requests remove themselves from this thread's
+	 *	trees and event list when they're freed, so they
+	 *	have to be freed here.
+	 */
+	talloc_free(this->ctx);
+
+	return NULL;
+}
+
+/** Setup a capture thread
+ *
+ * @param[in] this	thread to setup.
+ * @param[in] id	of the thread.
+ * @param[in] in	handles opened by the main thread.  Thread 0 uses these, the other
+ *			threads open their own handles on the same interfaces, and join
+ *			the same fanout groups.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int rs_thread_init(rs_thread_t *this, int id, fr_pcap_t *in)
+{
+	fr_pcap_t	*in_p;
+	fr_pcap_t	**head;
+
+	this->id = id;
+
+	this->ctx = talloc_init("radsniff thread %i", id);
+	if (!this->ctx) return -1;
+
+	this->stats = talloc_zero(conf, rs_stats_t);
+	if (!this->stats) return -1;
+
+	if (conf->metrics.file || conf->metrics.listen) {
+		this->stats->peers = fr_hash_table_create(this->stats, rs_peer_hash, rs_peer_cmp, NULL);
+		if (!this->stats->peers) return -1;
+	}
+
+	pthread_mutex_init(&this->mutex, NULL);
+
+	this->el = fr_event_list_alloc(this->ctx, _rs_event_status, NULL);
+	if (!this->el) {
+		ERROR("Failed creating event list for thread %i", id);
+		return -1;
+	}
+
+	this->request_tree = rbtree_create(this->ctx, (rbcmp) rs_packet_cmp, _unmark_request, 0);
+	if (!this->request_tree) {
+		ERROR("Failed creating request tree for thread %i", id);
+		return -1;
+	}
+
+	if (conf->link_da_num) {
+		this->link_tree = rbtree_create(this->ctx, (rbcmp) rs_rtx_cmp, _unmark_link, 0);
+		if (!this->link_tree) {
+			ERROR("Failed creating RTX tree for thread %i", id);
+			return -1;
+		}
+	}
+
+	if (id == 0) {
+		this->in = in;
+	} else {
+		head = &this->in;
+		for (in_p = in;
+		     in_p;
+		     in_p = in_p->next) {
+			fr_pcap_t *tmp;
+
+			tmp = fr_pcap_init(this->ctx, in_p->name, in_p->type);
+			if (!tmp) return -1;
+
+			tmp->promiscuous = in_p->promiscuous;
+			tmp->buffer_pkts = in_p->buffer_pkts;
+			tmp->fanout_group = in_p->fanout_group;
+			if (fr_pcap_open(tmp) < 0) {
+				ERROR("Failed opening pcap handle (%s) for thread %i: %s", tmp->name, id, fr_strerror());
+				return -1;
+			}
+
+			if (conf->pcap_filter && (fr_pcap_apply_filter(tmp, conf->pcap_filter) < 0)) {
+				ERROR("Failed applying filter");
+				return -1;
+			}
+
+			*head = tmp;
+			head = &tmp->next;
+		}
+	}
+
+	if (pipe(this->pipe) < 0) {
+		ERROR("Couldn't open pipe for thread %i: %s", id, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fr_event_fd_insert(NULL, this->el, this->pipe[0], rs_thread_stop, NULL, NULL, this) < 0) {
+		ERROR("Failed inserting pipe descriptor for thread %i: %s", id, fr_strerror());
+		return -1;
+	}
+
+	for (in_p = this->in;
+	     in_p;
+	     in_p = in_p->next) {
+		rs_event_t *event;
+
+		event = talloc_zero(this->el, rs_event_t);
+		event->list = this->el;
+		event->in = in_p;
+		event->stats = this->stats;
+
+		if (fr_event_fd_insert(NULL, this->el, in_p->fd, rs_got_packet, NULL, NULL, event) < 0) {
+			ERROR("Failed inserting file descriptor for thread %i", id);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Tell the capture threads to stop, and wait for them
+ *
+ */
+static void rs_threads_stop(void)
+{
+	int i;
+
+	for (i = 0; i < conf->threads; i++) {
+		if (!threads[i].running) {
+			TALLOC_FREE(threads[i].ctx);
+			continue;
+		}
+
+		if (write(threads[i].pipe[1], "", 1) < 0) {
+			ERROR("Failed stopping thread %i: %s", i, fr_syserror(errno));
+			continue;
+		}
+		pthread_join(threads[i].pthread_id, NULL);
+		threads[i].running = false;
+	}
+
+	for (i = 0; i < conf->threads; i++) {
+		if (threads[i].pipe[0] >= 0) close(threads[i].pipe[0]);
+		if (threads[i].pipe[1] >= 0) close(threads[i].pipe[1]);
+		threads[i].pipe[0] = threads[i].pipe[1] = -1;
+	}
+}
+
 static void NEVER_RETURNS usage(int status)
 {
 	FILE *output = status ? stderr : stdout;
@@ -2119,12 +2618,15 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "  -R <filter>           RADIUS attribute response filter.\n");
 	fprintf(output, "  -s <secret>           RADIUS secret.\n");
 	fprintf(output, "  -S                    Write PCAP data to stdout.\n");
+	fprintf(output, "  -t <threads>          Capture with this many threads (Linux only, defaults to 1).\n");
 	fprintf(output, "  -v                    Show program version information.\n");
 	fprintf(output, "  -w <file>             Write output packets to file.\n");
 	fprintf(output, "  -x                    Print more debugging information.\n");
 	fprintf(output, "stats options:\n");
 	fprintf(output, "  -W <interval>         Periodically write out statistics every <interval> seconds.\n");
 	fprintf(output, "  -E                    Print stats in CSV format.\n");
+	fprintf(output, "  -M <file>             Write stats in OpenMetrics format to <file> every interval.\n");
+	fprintf(output, "  -H <[addr:]port>      Serve stats in OpenMetrics format over HTTP.\n");
 	fprintf(output, "  -T <timeout>          How many milliseconds before the request is counted as lost "
 		"(defaults to %i).\n", RS_DEFAULT_TIMEOUT);
 #ifdef HAVE_COLLECTDC_H
@@ -2189,6 +2691,7 @@ int main(int argc, char *argv[])
 	 */
 	conf->print_packet = true;
 	conf->limit = 0;
+	conf->threads = 1;
 	conf->promiscuous = true;
 #ifdef HAVE_COLLECTDC_H
 	conf->stats.prefix = RS_DEFAULT_PREFIX;
@@ -2203,7 +2706,7 @@ int main(int argc, char *argv[])
 	/*
 	 *  Get options
 	 */
-	while ((opt = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hi:I:l:L:mp:P:qr:R:s:Svw:xXW:T:P:N:O:")) != EOF) {
+	while ((opt = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hH:i:I:l:L:mM:p:P:qr:R:s:St:vw:xXW:T:P:N:O:")) != EOF) {
 		switch (opt) {
 		case 'a':
 		{
@@ -2339,6 +2842,14 @@ int main(int argc, char *argv[])
 			conf->to_stdout = true;
 			break;
 
+		case 't':
+			conf->threads = atoi(optarg);
+			if ((conf->threads < 1) || (conf->threads > RS_THREADS_MAX)) {
+				ERROR("Number of capture threads must be between 1 and %i", RS_THREADS_MAX);
+				usage(64);
+			}
+			break;
+
 		case 'v':
 #ifdef HAVE_COLLECTDC_H
 			INFO("%s, %s, collectdclient version %s", radsniff_version, pcap_lib_version(),
@@ -2371,6 +2882,14 @@ int main(int argc, char *argv[])
 			}
 			break;
 
+		case 'M':
+			conf->metrics.file = optarg;
+			break;
+
+		case 'H':
+			conf->metrics.listen = optarg;
+			break;
+
 		case 'T':
 			conf->stats.timeout = atoi(optarg);
 			if (conf->stats.timeout <= 0) {
@@ -2433,6 +2952,17 @@ int main(int argc, char *argv[])
 		usage(64);
 	}
 
+	/* OpenMetrics are written by the stats processor, and include per NAS and home server stats */
+	if (conf->metrics.file || conf->metrics.listen) {
+		if (!conf->stats.interval) {
+			ERROR("OpenMetrics output requires a stats interval");
+			usage(64);
+		}
+
+		stats->peers = fr_hash_table_create(stats, rs_peer_hash, rs_peer_cmp, NULL);
+		if (!stats->peers) goto finish;
+	}
+
 	/* Reading from file overrides stdin */
 	if (conf->from_stdin && (conf->from_file || conf->from_dev)) {
 		conf->from_stdin = false;
@@ -2443,6 +2973,16 @@ int main(int argc, char *argv[])
 		conf->to_stdout = false;
 	}
 
+	/*
+	 *	Capture threads each see some of the packets on the
+	 *	interfaces, which only works for live capture.  We
+	 *	also don't serialise writes to the pcap output.
+	 */
+	if ((conf->threads > 1) && (conf->from_file || conf->from_stdin || conf->to_file || conf->to_stdout)) {
+		ERROR("Multiple capture threads can only be used for live capture, without PCAP output");
+		usage(64);
+	}
+
 	if (conf->to_stdout) {
 		out = fr_pcap_init(conf, "stdout", PCAP_STDIO_OUT);
 		if (!out) {
@@ -2588,6 +3128,7 @@ int main(int argc, char *argv[])
 	/*
 	 *	Setup the request tree
 	 */
+	request_ctx = conf;
 	request_tree = rbtree_create(conf, (rbcmp) rs_packet_cmp, _unmark_request, 0);
 	if (!request_tree) {
 		ERROR("Failed creating request tree");
@@ -2717,6 +3258,18 @@ int main(int argc, char *argv[])
 		     in_p = in_p->next) {
 			in_p->promiscuous = conf->promiscuous;
 			in_p->buffer_pkts = conf->buffer_pkts;
+
+			/*
+			 *	Group IDs are shared by every process on the
+			 *	system, and a group can only contain handles
+			 *	on one interface, so use a different ID for
+			 *	each interface, and mix in our PID.
+			 */
+			if (conf->threads > 1) {
+				in_p->fanout_group = ((getpid() * 31) + if_nametoindex(in_p->name)) & 0xffff;
+				if (!in_p->fanout_group) in_p->fanout_group = 1;
+			}
+
 			if (fr_pcap_open(in_p) < 0) {
 				ERROR("Failed opening pcap handle (%s): %s", in_p->name, fr_strerror());
 				if (conf->from_auto || (in_p->type == PCAP_FILE_IN)) {
@@ -2797,6 +3350,8 @@ int main(int argc, char *argv[])
 			goto finish;
 		}
 
+		if (rs_stats_openmetrics_open(conf, events) < 0) goto finish;
+
 		/*
 		 *  Initialise the signal handler pipe
 		 */
@@ -2811,22 +3366,42 @@ int main(int argc, char *argv[])
 		}
 
 		/*
-		 *  Now add fd's for each of the pcap sessions we opened
+		 *  Now add fd's for each of the pcap sessions we opened,
+		 *  either to our event list, or to the capture threads.
+		 *  The threads are started later, as we may fork.
 		 */
-		for (in_p = in;
-		     in_p;
-		     in_p = in_p->next) {
-			rs_event_t *event;
+		if (conf->threads > 1) {
+			int i;
 
-			event = talloc_zero(events, rs_event_t);
-			event->list = events;
-			event->in = in_p;
-			event->out = out;
-			event->stats = stats;
+			threads = talloc_zero_array(conf, rs_thread_t, conf->threads);
+			for (i = 0; i < conf->threads; i++) threads[i].pipe[0] = threads[i].pipe[1] = -1;
 
-			if (fr_event_fd_insert(NULL, events, in_p->fd, rs_got_packet, NULL, NULL, event) < 0) {
-				ERROR("Failed inserting file descriptor");
-				goto finish;
+			for (i = 0; i < conf->threads; i++) {
+				if (rs_thread_init(&threads[i], i, in) < 0) goto finish;
+			}
+
+			/*
+			 *  Packet timestamps are relative to when we
+			 *  started, as any of the threads may see the
+			 *  first packet.
+			 */
+			gettimeofday(&start_pcap, NULL);
+		} else {
+			for (in_p = in;
+			     in_p;
+			     in_p = in_p->next) {
+				rs_event_t *event;
+
+				event = talloc_zero(events, rs_event_t);
+				event->list = events;
+				event->in = in_p;
+				event->out = out;
+				event->stats = stats;
+
+				if (fr_event_fd_insert(NULL, events, in_p->fd, rs_got_packet, NULL, NULL, event) < 0) {
+					ERROR("Failed inserting file descriptor");
+					goto finish;
+				}
 			}
 		}
 
@@ -2834,11 +3409,12 @@ int main(int argc, char *argv[])
 		DEBUG("Sniffing on (%s)", buff);
 
 		/*
-		 *  Insert our stats processor
+		 *  Insert our stats processor.  With capture threads
+		 *  it merges the threads' stats each interval.
 		 */
 		if (conf->stats.interval && conf->from_dev) {
 			gettimeofday(&now, NULL);
-			rs_install_stats_processor(stats, events, in, &now, false);
+			rs_install_stats_processor(stats, events, threads ? NULL : in, &now, false);
 		}
 	}
 
@@ -2860,6 +3436,20 @@ int main(int argc, char *argv[])
 #ifdef SIGQUIT
 	fr_set_signal(SIGQUIT, rs_signal_self);
 #endif
+	if (threads) {
+		int i, rcode;
+
+		for (i = 0; i < conf->threads; i++) {
+			rcode = pthread_create(&threads[i].pthread_id, NULL, rs_thread_main, &threads[i]);
+			if (rcode != 0) {
+				ERROR("Failed creating capture thread %i: %s", i, fr_syserror(rcode));
+				goto finish;
+			}
+			threads[i].running = true;
+		}
+		DEBUG2("Capturing with %i threads", conf->threads);
+	}
+
 	DEBUG2("Entering event loop");
 
 	fr_event_loop(events);	/* Enter the main event loop */
@@ -2869,6 +3459,8 @@ int main(int argc, char *argv[])
 finish:
 	cleanup = true;
 
+	if (threads) rs_threads_stop();
+
 	/*
 	 *	Free all the things! This also closes all the sockets and file descriptors
 	 */
@@ -0,0 +1,449 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file reload.c
+ * @brief Reload data read from a file, without blocking the threads which use it.
+ *
+ * A thread checks the file every "interval".  Once it has changed, and
+ * then stayed the same for another interval, the thread reads it, and
+ * swaps the new data in with one atomic store.  Threads which look
+ * things up in the data never take a lock, or wait for a reload.
+ *
+ * The old data is freed once no thread can still be using it.  Each
+ * thread which uses the data records the reload "epoch" when it starts
+ * using it, and clears it again when it's done.  After swapping in new
+ * data, the reload thread increments the epoch, and waits until no
+ * thread has a number older than that.
+ *
+ * @copyright 2026  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/reload.h>
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#define RELOAD_POLL	10	//!< Milliseconds between checks for threads using the old data.
+
+/** One version of the data
+ *
+ */
+typedef struct {
+	void			*data;		//!< From the load callback.
+	uint64_t		generation;	//!< Incremented each time the file is read.
+} fr_reload_data_t;
+
+/** A thread which uses the data
+ *
+ */
+typedef struct fr_reload_reader_t fr_reload_reader_t;
+struct fr_reload_reader_t {
+	_Atomic(uint64_t)	epoch;		//!< When the thread started using the data, or 0 if it's not.
+	uint32_t		depth;		//!< Nested calls to fr_reload_enter().  Only used by the thread.
+
+	fr_reload_t		*reload;
+	fr_reload_reader_t	*next;		//!< In the list of readers.
+};
+
+struct fr_reload_t {
+	char const		*name;		//!< For log messages.
+	char const		*filename;
+	struct timeval		interval;	//!< How often we check the file.
+
+	fr_reload_load_t	load;
+	void			*uctx;
+
+	atomic_uintptr_t	current;	//!< fr_reload_data_t in use.
+	_Atomic(uint64_t)	epoch;		//!< Starts at 1, so that 0 can mean "not in use".
+	uint64_t		generation;	//!< Of the last data we read.
+
+	struct stat		loaded;		//!< The file when we last read it.
+	struct stat		pending;	//!< The file when we saw it had changed.
+	bool			changed;	//!< "pending" is set.
+	bool			missing;	//!< We've complained the file can't be found.
+
+	pthread_key_t		key;		//!< This thread's reader.
+	pthread_mutex_t		mutex;		//!< Protects "readers", and "stop".
+	pthread_cond_t		cond;		//!< Wakes the reload thread when we stop.
+	fr_reload_reader_t	*readers;
+
+	bool			running;	//!< There's a reload thread.
+	bool			stop;		//!< The reload thread should exit.
+	pthread_t		thread;
+};
+
+/** Remove a reader when its thread exits
+ *
+ */
+static void _reload_reader_free(void *arg)
+{
+	fr_reload_reader_t	*r = arg;
+	fr_reload_reader_t	**last;
+
+	pthread_mutex_lock(&r->reload->mutex);
+	for (last = &r->reload->readers; *last; last = &(*last)->next) {
+		if (*last != r) continue;
+
+		*last = r->next;
+		break;
+	}
+	pthread_mutex_unlock(&r->reload->mutex);
+
+	free(r);
+}
+
+/** Get this thread's reader, creating it if necessary
+ *
+ */
+static fr_reload_reader_t *reload_reader(fr_reload_t *reload)
+{
+	fr_reload_reader_t *r;
+
+	r = pthread_getspecific(reload->key);
+	if (r) return r;
+
+	MEM(r = calloc(1, sizeof(*r)));
+	r->reload = reload;
+
+	pthread_mutex_lock(&reload->mutex);
+	r->next = reload->readers;
+	reload->readers = r;
+	pthread_mutex_unlock(&reload->mutex);
+
+	(void) pthread_setspecific(reload->key, r);
+
+	return r;
+}
+
+/** Start using the data
+ *
+ * The data won't be freed until the thread calls fr_reload_leave().
+ * The thread must not yield in between.
+ *
+ * @param[in] reload		to get the data from.
+ * @param[out] generation	of the data.  Changes each time the file is
+ *				read, so that threads can tell when to rebuild
+ *				anything they've cached about the data.  May
+ *				be NULL.
+ * @return the data returned by the load callback.
+ */
+void const *fr_reload_enter(fr_reload_t *reload, uint64_t *generation)
+{
+	fr_reload_reader_t	*r = reload_reader(reload);
+	fr_reload_data_t const	*current;
+
+	/*
+	 *	The epoch must be visible to the reload thread
+	 *	before we get the data.
+	 */
+	if (r->depth++ == 0) atomic_store(&r->epoch, atomic_load(&reload->epoch));
+
+	current = (fr_reload_data_t const *) atomic_load(&reload->current);
+	if (generation) *generation = current->generation;
+
+	return current->data;
+}
+
+/** Stop using the data
+ *
+ */
+void fr_reload_leave(fr_reload_t *reload)
+{
+	fr_reload_reader_t *r = pthread_getspecific(reload->key);
+
+	rad_assert(r && r->depth);
+
+	if (--r->depth == 0) atomic_store(&r->epoch, 0);
+}
+
+/** Read the file
+ *
+ */
+static fr_reload_data_t *reload_load(fr_reload_t *reload)
+{
+	fr_reload_data_t	*rd;
+	struct timeval		start, end, elapsed;
+	uint64_t		entries = 0;
+
+	gettimeofday(&start, NULL);
+
+	/*
+	 *	Not parented to the reload, as it's allocated by the
+	 *	reload thread.
+	 */
+	rd = talloc_zero(NULL, fr_reload_data_t);
+	if (!rd) return NULL;
+
+	rd->data = reload->load(rd, reload->filename, reload->uctx, &entries);
+	if (!rd->data) {
+		talloc_free(rd);
+		return NULL;
+	}
+	rd->generation = ++reload->generation;
+
+	gettimeofday(&end, NULL);
+	fr_timeval_subtract(&elapsed, &end, &start);
+
+	INFO("%s - Read %" PRIu64 " entries from %s in %u.%06u seconds", reload->name, entries, reload->filename,
+	     (unsigned int) elapsed.tv_sec, (unsigned int) elapsed.tv_usec);
+
+	return rd;
+}
+
+/** See whether any thread might still be using data older than "epoch"
+ *
+ */
+static bool reload_busy(fr_reload_t *reload, uint64_t epoch)
+{
+	fr_reload_reader_t	*r;
+	bool			busy = false;
+
+	pthread_mutex_lock(&reload->mutex);
+	for (r = reload->readers; r; r = r->next) {
+		uint64_t used = atomic_load(&r->epoch);
+
+		if (used && (used < epoch)) {
+			busy = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&reload->mutex);
+
+	return busy;
+}
+
+/** Swap in new data, and free the old data once no thread is using it
+ *
+ */
+static void reload_swap(fr_reload_t *reload, fr_reload_data_t *rd)
+{
+	fr_reload_data_t	*old;
+	uint64_t		epoch;
+
+	old = (fr_reload_data_t *) atomic_exchange(&reload->current, (uintptr_t) rd);
+	epoch = atomic_fetch_add(&reload->epoch, 1) + 1;
+
+	while (reload_busy(reload, epoch)) {
+		struct timespec ts = { 0, RELOAD_POLL * 1000000 };
+
+		nanosleep(&ts, NULL);
+	}
+
+	talloc_free(old);
+}
+
+static bool reload_same(struct stat const *a, struct stat const *b)
+{
+	return (a->st_ino == b->st_ino) && (a->st_dev == b->st_dev) &&
+	       (a->st_size == b->st_size) && (a->st_mtime == b->st_mtime);
+}
+
+/** See if the file has changed, and read it if so
+ *
+ */
+static void reload_check(fr_reload_t *reload)
+{
+	struct stat		st;
+	fr_reload_data_t	*rd;
+
+	if (stat(reload->filename, &st) < 0) {
+		if (!reload->missing) {
+			WARN("%s - Failed to stat %s, continuing with the previous data: %s", reload->name,
+			     reload->filename, fr_syserror(errno));
+			reload->missing = true;
+		}
+		return;
+	}
+	reload->missing = false;
+
+	if (reload_same(&st, &reload->loaded)) {
+		reload->changed = false;
+		return;
+	}
+
+	/*
+	 *	Wait until the file stops changing, so that we
+	 *	don't read it while it's being written.
+	 */
+	if (!reload->changed || !reload_same(&st, &reload->pending)) {
+		reload->pending = st;
+		reload->changed = true;
+		return;
+	}
+
+	/*
+	 *	Even if we can't read it, so that a broken file isn't
+	 *	read again every interval.
+	 */
+	reload->loaded = st;
+	reload->changed = false;
+
+	rd = reload_load(reload);
+	if (!rd) {
+		ERROR("%s - Failed reading %s, continuing with the previous data", reload->name, reload->filename);
+		return;
+	}
+
+	reload_swap(reload, rd);
+}
+
+static void *reload_thread(void *arg)
+{
+	fr_reload_t *reload = arg;
+
+	pthread_mutex_lock(&reload->mutex);
+	while (!reload->stop) {
+		struct timeval	now, when;
+		struct timespec	ts;
+
+		gettimeofday(&now, NULL);
+		fr_timeval_add(&when, &now, &reload->interval);
+		ts.tv_sec = when.tv_sec;
+		ts.tv_nsec = when.tv_usec * 1000;
+
+		(void) pthread_cond_timedwait(&reload->cond, &reload->mutex, &ts);
+		if (reload->stop) break;
+
+		pthread_mutex_unlock(&reload->mutex);
+		reload_check(reload);
+		pthread_mutex_lock(&reload->mutex);
+	}
+	pthread_mutex_unlock(&reload->mutex);
+
+	return NULL;
+}
+
+static int _reload_free(fr_reload_t *reload)
+{
+	fr_reload_reader_t *r, *next;
+
+	if (reload->running) {
+		pthread_mutex_lock(&reload->mutex);
+		reload->stop = true;
+		pthread_cond_signal(&reload->cond);
+		pthread_mutex_unlock(&reload->mutex);
+
+		(void) pthread_join(reload->thread, NULL);
+	}
+
+	/*
+	 *	Threads which are still running won't call the key
+	 *	destructor once it's deleted, so free the readers
+	 *	here.
+	 */
+	(void) pthread_key_delete(reload->key);
+	for (r = reload->readers; r; r = next) {
+		next = r->next;
+		free(r);
+	}
+
+	talloc_free((fr_reload_data_t *) atomic_load(&reload->current));
+
+	pthread_cond_destroy(&reload->cond);
+	pthread_mutex_destroy(&reload->mutex);
+
+	return 0;
+}
+
+/** Read a file, and re-read it whenever it changes
+ *
+ * The file is read before this function returns.  If "interval" is set,
+ * a thread then checks the file for changes, and reads it again in the
+ * background.  If the new file can't be read, the previous data is used.
+ *
+ * @param[in] ctx	to allocate the reload in.
+ * @param[in] name	for log messages, usually the module instance name.
+ * @param[in] filename	to read.
+ * @param[in] interval	how often to check whether the file has changed.
+ *			NULL or zero means the file is only read once.
+ * @param[in] load	called to read the file.
+ * @param[in] uctx	passed to the load callback.
+ * @return
+ *	- The new reload.
+ *	- NULL if the file couldn't be read.
+ */
+fr_reload_t *fr_reload_alloc(TALLOC_CTX *ctx, char const *name, char const *filename,
+			     struct timeval const *interval, fr_reload_load_t load, void *uctx)
+{
+	fr_reload_t		*reload;
+	fr_reload_data_t	*rd;
+	int			rcode;
+
+	reload = talloc_zero(ctx, fr_reload_t);
+	if (!reload) return NULL;
+
+	reload->name = talloc_typed_strdup(reload, name);
+	reload->filename = talloc_typed_strdup(reload, filename);
+	if (interval) reload->interval = *interval;
+	reload->load = load;
+	reload->uctx = uctx;
+
+	if (stat(filename, &reload->loaded) < 0) {
+		ERROR("%s - Failed to stat %s: %s", name, filename, fr_syserror(errno));
+		talloc_free(reload);
+		return NULL;
+	}
+
+	rcode = pthread_key_create(&reload->key, _reload_reader_free);
+	if (rcode != 0) {
+		ERROR("%s - Failed creating thread key: %s", name, fr_syserror(rcode));
+		talloc_free(reload);
+		return NULL;
+	}
+	pthread_mutex_init(&reload->mutex, NULL);
+	pthread_cond_init(&reload->cond, NULL);
+
+	rd = reload_load(reload);
+	if (!rd) {
+		(void) pthread_key_delete(reload->key);
+		pthread_cond_destroy(&reload->cond);
+		pthread_mutex_destroy(&reload->mutex);
+		talloc_free(reload);
+		return NULL;
+	}
+
+	atomic_init(&reload->current, (uintptr_t) rd);
+	atomic_init(&reload->epoch, 1);
+	talloc_set_destructor(reload, _reload_free);
+
+	/*
+	 *	Nothing is going to use the data when we're only
+	 *	checking the configuration.
+	 */
+	if (check_config || !timerisset(&reload->interval)) return reload;
+
+	rcode = pthread_create(&reload->thread, NULL, reload_thread, reload);
+	if (rcode != 0) {
+		ERROR("%s - Failed creating reload thread: %s", name, fr_syserror(rcode));
+		talloc_free(reload);
+		return NULL;
+	}
+	reload->running = true;
+
+	return reload;
+}
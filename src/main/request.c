@@ -72,13 +72,50 @@ static int _request_free(REQUEST *request)
 	 */
 	if (request->state_ctx) talloc_free(request->state_ctx);
 
+	/*
+	 *	A stack from request_alloc_recycled() which the caller
+	 *	didn't take back.
+	 */
+	if (request->recycle && request->stack) talloc_free(request->stack);
+
 	return 0;
 }
 
-/** Create a new REQUEST data structure
+/** Allocate an unlang stack
  *
  */
-REQUEST *request_alloc(TALLOC_CTX *ctx)
+static void *request_stack_alloc(TALLOC_CTX *ctx)
+{
+#ifdef HAVE_TALLOC_POOLED_OBJECT
+	/*
+	 *	If we have talloc_pooled_object allocate the
+	 *	stack as a combined chunk/pool, with memory
+	 *	to hold at mutable data for at least a quarter
+	 *	of the maximum number of stack frames.
+	 *
+	 *	Having a dedicated pool for mutable stack data
+	 *	means we don't have memory fragmentations issues
+	 *	as we would if request were used as the pool.
+	 *
+	 *	This number is pretty arbitrary, but it seems
+	 *	like too low level to make into a tuneable.
+	 */
+	unlang_stack_t *stack;
+
+	stack = talloc_pooled_object(ctx, unlang_stack_t, UNLANG_STACK_MAX / 4,
+				     sizeof(unlang_stack_state_t));
+	if (stack) memset(stack, 0, sizeof(*stack));
+
+	return stack;
+#else
+	return talloc_zero(ctx, unlang_stack_t);
+#endif
+}
+
+/** Fill in a new REQUEST
+ *
+ */
+static REQUEST *request_init(TALLOC_CTX *ctx)
 {
 	REQUEST *request;
 
@@ -107,32 +144,107 @@ REQUEST *request_alloc(TALLOC_CTX *ctx)
 	request->module = NULL;
 	request->component = "<core>";
 
-#ifdef HAVE_TALLOC_POOLED_OBJECT
-	/*
-	 *	If we have talloc_pooled_object allocate the
-	 *	stack as a combined chunk/pool, with memory
-	 *	to hold at mutable data for at least a quarter
-	 *	of the maximum number of stack frames.
-	 *
-	 *	Having a dedicated pool for mutable stack data
-	 *	means we don't have memory fragmentations issues
-	 *	as we would if request were used as the pool.
-	 *
-	 *	This number is pretty arbitrary, but it seems
-	 *	like too low level to make into a tuneable.
-	 */
-	request->stack = talloc_pooled_object(request, unlang_stack_t, UNLANG_STACK_MAX / 4,
-					      sizeof(unlang_stack_state_t));
-#else
-	request->stack = talloc_zero(request, unlang_stack_t);
-#endif
 	request->heap_id = -1;
 
+	return request;
+}
+
+/** Create a new REQUEST data structure
+ *
+ */
+REQUEST *request_alloc(TALLOC_CTX *ctx)
+{
+	REQUEST *request;
+
+	request = request_init(ctx);
+	if (!request) return NULL;
+
+	request->stack = request_stack_alloc(request);
 	request->state_ctx = talloc_init("session-state");
 
 	return request;
 }
 
+/** Create a new REQUEST, reusing the stack and session-state context of a previous one
+ *
+ *  Together, these are most of the memory of a REQUEST, and the
+ *  session-state context is a separate malloc().  A caller which
+ *  creates many requests can keep them, with request_recycle(), and
+ *  pass them back in here.
+ *
+ *  The stack isn't a talloc child of the request.  If the caller
+ *  frees the request without calling request_recycle(), the stack
+ *  and the session-state context are freed with it.
+ *
+ * @param[in] ctx		to allocate the request in.
+ * @param[in] stack		from request_recycle(), or NULL to allocate a new one.
+ * @param[in] state_ctx		from request_recycle(), or NULL to allocate a new one.
+ * @return
+ *	- the new request.  It owns "stack" and "state_ctx".
+ *	- NULL on error.  The caller still owns "stack" and "state_ctx".
+ */
+REQUEST *request_alloc_recycled(TALLOC_CTX *ctx, void *stack, TALLOC_CTX *state_ctx)
+{
+	REQUEST *request;
+
+	request = request_init(ctx);
+	if (!request) return NULL;
+
+	request->stack = stack ? stack : request_stack_alloc(NULL);
+	request->state_ctx = state_ctx ? state_ctx : talloc_init("session-state");
+	if (!request->stack || !request->state_ctx) {
+		if (request->stack != stack) talloc_free(request->stack);
+		if (request->state_ctx != state_ctx) talloc_free(request->state_ctx);
+		request->stack = NULL;
+		request->state_ctx = NULL;
+		talloc_free(request);
+		return NULL;
+	}
+
+	request->recycle = true;
+
+	return request;
+}
+
+/** Take back the stack and session-state context of a request, so they can be reused
+ *
+ *  Anything left on the stack, or in the session-state context, is
+ *  freed.  If the state was saved for the next packet (see
+ *  fr_request_to_state()), the request no longer has a session-state
+ *  context, and none is returned.
+ *
+ * @param[in] request		allocated by request_alloc_recycled().  It must be
+ *				freed afterwards.
+ * @param[out] stack		the stack, or NULL.
+ * @param[out] state_ctx	the session-state context, or NULL.
+ */
+void request_recycle(REQUEST *request, void **stack, TALLOC_CTX **state_ctx)
+{
+	unlang_stack_t *our_stack = request->stack;
+
+	*stack = NULL;
+	*state_ctx = NULL;
+
+	if (!request->recycle) return;
+
+	if (our_stack) {
+		talloc_free_children(our_stack);
+		our_stack->depth = 0;
+		memset(&our_stack->frame[0], 0, sizeof(our_stack->frame[0]));
+
+		*stack = our_stack;
+		request->stack = NULL;
+	}
+
+	if (request->state_ctx) {
+		talloc_free_children(request->state_ctx);
+		request->state = NULL;
+
+		*state_ctx = request->state_ctx;
+		request->state_ctx = NULL;
+	}
+}
+
 
 /*
  *	Create a new REQUEST, based on an old one.
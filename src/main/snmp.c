@@ -152,9 +152,12 @@ static int snmp_config_reset_set(NDEBUG_UNUSED fr_snmp_map_t const *map, UNUSED
 static int snmp_auth_stats_offset_get(UNUSED TALLOC_CTX *ctx, fr_value_box_t *out,
 				      fr_snmp_map_t const *map, UNUSED void *snmp_ctx)
 {
+	fr_stats_t stats;
+
 	rad_assert(map->da->type == FR_TYPE_UINT32);
 
-	out->vb_uint32 = *(uint32_t *)((uint8_t *)(&radius_auth_stats) + map->offset);
+	radius_stats_read(&stats, &radius_stats_server, RADIUS_STATS_AUTH);
+	out->vb_uint32 = *(uint32_t *)((uint8_t *)(&stats) + map->offset);
 
 	return 0;
 }
@@ -229,11 +232,13 @@ static int snmp_auth_client_stats_offset_get(UNUSED TALLOC_CTX *ctx, fr_value_bo
 				  	     fr_snmp_map_t const *map, void *snmp_ctx)
 {
 	RADCLIENT *client = snmp_ctx;
+	fr_stats_t stats;
 
 	rad_assert(client);
 	rad_assert(map->da->type == FR_TYPE_UINT32);
 
-	out->vb_uint32 = *(uint32_t *)((uint8_t *)(&client->auth) + map->offset);
+	radius_stats_read(&stats, &client->stats_id, RADIUS_STATS_AUTH);
+	out->vb_uint32 = *(uint32_t *)((uint8_t *)(&stats) + map->offset);
 
 	return 0;
 }
@@ -0,0 +1,339 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file startup_trace.c
+ * @brief Record how long each phase of server startup takes.
+ *
+ * Each phase records the wall time it took, and how much talloc memory
+ * it left allocated.  Phases nest, and the numbers for a phase include
+ * the phases inside it.  When the server has started, the phases are
+ * written to a file as JSON, and a summary is logged.
+ *
+ * Memory is measured by walking the whole talloc tree, which is slow.
+ * The walk isn't counted in the time of the phase being measured, but
+ * is counted in the phases around it.  Once worker threads are started
+ * the tree can't be walked safely, so later phases have no memory
+ * figures.
+ *
+ * @copyright 2026  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/startup_trace.h>
+
+#define USEC (1000000)
+
+struct fr_startup_phase_t {
+	char const		*phase;		//!< e.g. "module.instantiate".
+	char const		*name;		//!< Of the thing the phase is for, may be NULL.
+
+	fr_startup_phase_t	*parent;	//!< Phase this one is inside of.
+	unsigned int		depth;		//!< How many phases this one is inside of.
+
+	struct timeval		start;		//!< When the phase started.
+	struct timeval		elapsed;	//!< How long the phase took.
+
+	bool			has_memory;	//!< Whether memory was measured.
+	size_t			mem_start;	//!< Allocated when the phase started.
+	int64_t			memory;		//!< Allocated by the phase, and still allocated.
+
+	bool			done;		//!< Phase has been stopped.
+};
+
+/*
+ *	Phases are allocated in a context which was created before
+ *	null tracking was enabled, so they don't count towards the
+ *	memory of the phases they're measuring.
+ */
+static TALLOC_CTX		*trace_ctx;
+static char const		*trace_file;
+static bool			trace_memory;
+static struct timeval		trace_start;
+
+static fr_startup_phase_t	**phases;
+static uint32_t			num_phases;
+static pthread_mutex_t		trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *	Worker threads instantiate at the same time, so each thread
+ *	has its own stack of phases.
+ */
+fr_thread_local_setup(fr_startup_phase_t *, current_phase)
+
+/** Enable startup tracing
+ *
+ * Must be called before anything which should be traced.
+ *
+ * @param[in] filename	to write the JSON report to.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_startup_trace_init(char const *filename)
+{
+	if (trace_ctx) return 0;
+
+	trace_ctx = talloc_init("startup trace");
+	if (!trace_ctx) return -1;
+
+	trace_file = talloc_typed_strdup(trace_ctx, filename);
+
+	talloc_enable_null_tracking();
+	trace_memory = true;
+
+	gettimeofday(&trace_start, NULL);
+
+	return 0;
+}
+
+/** Whether startup tracing is enabled
+ *
+ */
+bool fr_startup_trace_enabled(void)
+{
+	return (trace_ctx != NULL);
+}
+
+/** Start a phase
+ *
+ * @param[in] phase	being started.  Must be a string literal.
+ * @param[in] fmt	for the name of the thing the phase is for.  May be NULL.
+ * @return
+ *	- The phase, which should be passed to #fr_startup_trace_stop.
+ *	- NULL if tracing isn't enabled.
+ */
+fr_startup_phase_t *fr_startup_trace_start(char const *phase, char const *fmt, ...)
+{
+	fr_startup_phase_t	*p;
+	fr_startup_phase_t	**new;
+	va_list			ap;
+
+	if (!trace_ctx) return NULL;
+
+	pthread_mutex_lock(&trace_mutex);
+	new = talloc_realloc(trace_ctx, phases, fr_startup_phase_t *, num_phases + 1);
+	if (!new) {
+		pthread_mutex_unlock(&trace_mutex);
+		return NULL;
+	}
+	phases = new;
+
+	p = talloc_zero(trace_ctx, fr_startup_phase_t);
+	if (!p) {
+		pthread_mutex_unlock(&trace_mutex);
+		return NULL;
+	}
+	phases[num_phases++] = p;
+
+	p->phase = phase;
+	if (fmt) {
+		va_start(ap, fmt);
+		p->name = talloc_vasprintf(p, fmt, ap);
+		va_end(ap);
+	}
+
+	p->parent = current_phase;
+	if (p->parent) p->depth = p->parent->depth + 1;
+	current_phase = p;
+
+	if (trace_memory) {
+		p->has_memory = true;
+		p->mem_start = talloc_total_size(NULL);
+	}
+	pthread_mutex_unlock(&trace_mutex);
+
+	gettimeofday(&p->start, NULL);
+
+	return p;
+}
+
+/** Stop a phase
+ *
+ * @param[in] p	to stop.  May be NULL.
+ */
+void fr_startup_trace_stop(fr_startup_phase_t *p)
+{
+	struct timeval now;
+
+	if (!p) return;
+
+	gettimeofday(&now, NULL);
+	fr_timeval_subtract(&p->elapsed, &now, &p->start);
+
+	pthread_mutex_lock(&trace_mutex);
+	if (p->has_memory && trace_memory) {
+		p->memory = (int64_t)talloc_total_size(NULL) - (int64_t)p->mem_start;
+	} else {
+		p->has_memory = false;
+	}
+	p->done = true;
+	pthread_mutex_unlock(&trace_mutex);
+
+	current_phase = p->parent;
+}
+
+/** Stop measuring memory
+ *
+ * Must be called before any other threads are started which allocate
+ * memory.
+ */
+void fr_startup_trace_memory_stop(void)
+{
+	pthread_mutex_lock(&trace_mutex);
+	trace_memory = false;
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+static uint64_t startup_trace_usec(struct timeval const *tv)
+{
+	return ((uint64_t)tv->tv_sec * USEC) + tv->tv_usec;
+}
+
+/** Write a string as JSON
+ *
+ */
+static void startup_trace_json_string(FILE *fp, char const *str)
+{
+	char const *p;
+
+	if (!str) {
+		fputs("null", fp);
+		return;
+	}
+
+	fputc('"', fp);
+	for (p = str; *p; p++) {
+		switch (*p) {
+		case '"':
+		case '\\':
+			fprintf(fp, "\\%c", *p);
+			break;
+
+		default:
+			if ((uint8_t)*p < 0x20) {
+				fprintf(fp, "\\u%04x", (uint8_t)*p);
+				break;
+			}
+			fputc(*p, fp);
+			break;
+		}
+	}
+	fputc('"', fp);
+}
+
+static int startup_trace_write(struct timeval const *total)
+{
+	FILE		*fp;
+	uint32_t	i;
+
+	fp = fopen(trace_file, "w");
+	if (!fp) {
+		ERROR("Failed opening startup trace file \"%s\": %s", trace_file, fr_syserror(errno));
+		return -1;
+	}
+
+	fprintf(fp, "{\n\t\"total_usec\": %" PRIu64 ",\n\t\"phases\": [", startup_trace_usec(total));
+
+	for (i = 0; i < num_phases; i++) {
+		fr_startup_phase_t	*p = phases[i];
+		struct timeval		offset;
+
+		fr_timeval_subtract(&offset, &p->start, &trace_start);
+
+		fprintf(fp, "%s\n\t\t{ \"phase\": ", i ? "," : "");
+		startup_trace_json_string(fp, p->phase);
+		fputs(", \"name\": ", fp);
+		startup_trace_json_string(fp, p->name);
+		fprintf(fp, ", \"depth\": %u, \"start_usec\": %" PRIu64 ", \"usec\": ",
+			p->depth, startup_trace_usec(&offset));
+		if (p->done) {
+			fprintf(fp, "%" PRIu64, startup_trace_usec(&p->elapsed));
+		} else {
+			fputs("null", fp);
+		}
+		fputs(", \"memory\": ", fp);
+		if (p->done && p->has_memory) {
+			fprintf(fp, "%" PRId64, p->memory);
+		} else {
+			fputs("null", fp);
+		}
+		fputs(" }", fp);
+	}
+
+	fputs("\n\t]\n}\n", fp);
+
+	if (fclose(fp) != 0) {
+		ERROR("Failed writing startup trace file \"%s\": %s", trace_file, fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Write the JSON report, log a summary, and stop tracing
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the report couldn't be written.
+ */
+int fr_startup_trace_report(void)
+{
+	struct timeval	now, total;
+	uint32_t	i;
+	int		ret;
+
+	if (!trace_ctx) return 0;
+
+	gettimeofday(&now, NULL);
+	fr_timeval_subtract(&total, &now, &trace_start);
+
+	pthread_mutex_lock(&trace_mutex);
+
+	INFO("Startup took %u.%06u seconds", (unsigned int) total.tv_sec, (unsigned int) total.tv_usec);
+
+	for (i = 0; i < num_phases; i++) {
+		fr_startup_phase_t	*p = phases[i];
+		char			memory[32];
+
+		if (!p->done) continue;
+
+		if (p->has_memory) {
+			snprintf(memory, sizeof(memory), "%" PRId64 " bytes", p->memory);
+		} else {
+			strlcpy(memory, "-", sizeof(memory));
+		}
+
+		INFO("  %*s%s%s%s %u.%06u seconds, %s", p->depth * 2, "", p->phase,
+		     p->name ? " " : "", p->name ? p->name : "",
+		     (unsigned int) p->elapsed.tv_sec, (unsigned int) p->elapsed.tv_usec, memory);
+	}
+
+	ret = startup_trace_write(&total);
+	if (ret == 0) INFO("Startup trace written to %s", trace_file);
+
+	TALLOC_FREE(trace_ctx);
+	phases = NULL;
+	num_phases = 0;
+	trace_memory = false;
+
+	pthread_mutex_unlock(&trace_mutex);
+
+	return ret;
+}
@@ -42,6 +42,24 @@
           \-> reply                 \-> reply                 \-> access-reject/access-accept
  * @endverbatim
  *
+ * Entries are spread over a number of shards, each with its own tree,
+ * expiry list and mutex, so requests for different authentication
+ * sessions rarely wait for each other.  The shard is chosen from the
+ * State value, which is random for the values we create, so every
+ * round of a session uses the same lookup, with no other index needed.
+ *
+ * Whilst they're held by an entry, the session-state VALUE_PAIRs are packed
+ * into a single buffer, as each VALUE_PAIR is several times larger than its
+ * value, and the entries of half-finished sessions can accumulate.
+ *
+ * A module may register a #fr_state_backend_t, to copy the session-state of
+ * each entry to storage shared with other servers.  The local entry is still
+ * used when the next round arrives at the same server.  When it doesn't, the
+ * lookup is recorded as a miss, and the module fetches the copy with
+ * #fr_state_missed and #fr_state_restore.  Only the session-state VALUE_PAIRs
+ * are copied.  Persistable request data only exists in the server which
+ * created it.
+ *
  * @copyright 2014 The FreeRADIUS server project
  */
 RCSID("$Id$")
@@ -49,6 +67,25 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/state.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/probe.h>
+#include <freeradius-devel/io/memory.h>
+#include <freeradius-devel/detail.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+/** Number of independently locked trees entries are spread over
+ *
+ */
+#define STATE_TREE_SHARDS	(16)
+
+/** Most entries to expire early, each time an entry is added, when over the soft limit
+ *
+ */
+#define STATE_EVICT_MAX		(4)
 
 /** Holds a state value, and associated VALUE_PAIRs and data
  *
@@ -102,28 +139,50 @@ typedef struct state_entry {
 	TALLOC_CTX		*ctx;				//!< ctx to parent any data that needs to be
 								//!< tied to the lifetime of the request progression.
 	VALUE_PAIR		*vps;				//!< session-state VALUE_PAIRs, parented by ctx.
+	uint8_t			*packed;			//!< session-state VALUE_PAIRs, packed by
+								//!< #state_pairs_pack.  Also parented by ctx.
 
 	request_data_t		*data;				//!< Persistable request data, also parented ctx.
+
+	size_t			size;				//!< Memory counted for the entry.  0 once the
+								//!< state has been restored to a request.
 } fr_state_entry_t;
 
-struct fr_state_tree_t {
-	uint64_t		id;				//!< Next ID to assign.
+/** A subset of the state entries, with its own lock
+ *
+ */
+typedef struct state_shard {
 	uint64_t		timed_out;			//!< Number of states that were cleaned up due to
 								//!< timeout.
-	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
 	rbtree_t		*tree;				//!< rbtree used to lookup state value.
 
 	fr_state_entry_t	*head, *tail;			//!< Entries to expire.
-	uint32_t		timeout;			//!< How long to wait before cleaning up state entires.
 	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	bool			mutex_init;			//!< Whether the mutex needs to be destroyed.
+} fr_state_shard_t;
+
+struct fr_state_tree_t {
+	atomic_uint_fast64_t	id;				//!< Next ID to assign.
+	atomic_uint_fast32_t	num_entries;			//!< Number of entries in all the shards.
+	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
+	uint32_t		timeout;			//!< How long to wait before cleaning up state entires.
+	fr_memory_t		*memory;			//!< Memory used by the entries.
+
+	fr_state_shard_t	shard[STATE_TREE_SHARDS];
 };
 
 fr_state_tree_t *global_state = NULL;
 
+/** Where copies of entries are written, if anywhere
+ *
+ * Set before any worker starts, and shared by all trees.
+ */
+static fr_state_backend_t const *state_backend = NULL;
+
 #define PTHREAD_MUTEX_LOCK if (main_config.spawn_workers) pthread_mutex_lock
 #define PTHREAD_MUTEX_UNLOCK if (main_config.spawn_workers) pthread_mutex_unlock
 
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry);
+static void state_entry_unlink(fr_state_tree_t *state, fr_state_shard_t *shard, fr_state_entry_t *entry);
 
 /** Compare two fr_state_entry_t based on their state value i.e. the value of the attribute
  *
@@ -135,34 +194,48 @@ static int state_entry_cmp(void const *one, void const *two)
 	return memcmp(a->state, b->state, sizeof(a->state));
 }
 
+/** Return the shard a state value lives in
+ *
+ * The value here is the one stored in the tree, with the server
+ * hash already mixed in.  Values created by modules may not be
+ * random in any particular byte, so we hash all of them.
+ */
+static inline fr_state_shard_t *state_shard(fr_state_tree_t *state, uint8_t const *value)
+{
+	return &state->shard[fr_hash(value, sizeof(((fr_state_entry_t *)NULL)->state)) % STATE_TREE_SHARDS];
+}
+
 /** Free the state tree
  *
  */
 static int _state_tree_free(fr_state_tree_t *state)
 {
 	fr_state_entry_t *this;
-
-	if (main_config.spawn_workers) pthread_mutex_destroy(&state->mutex);
+	int i;
 
 	DEBUG4("Freeing state tree %p", state);
 
-	while (state->head) {
-		this = state->head;
-		state_entry_unlink(state, this);
-		talloc_free(this);
-	}
+	for (i = 0; i < STATE_TREE_SHARDS; i++) {
+		fr_state_shard_t *shard = &state->shard[i];
 
-	for (this = state->head; this; this = this->next) DEBUG4("State %" PRIu64 " needs freeing prev was %" PRIu64 "", this->id, this->prev ? this->prev->id : 100000);
+		if (shard->mutex_init) pthread_mutex_destroy(&shard->mutex);
 
-	/*
-	 *	Ensure we got *all* the entries
-	 */
-	rad_assert(!state->head);
+		while (shard->head) {
+			this = shard->head;
+			state_entry_unlink(state, shard, this);
+			talloc_free(this);
+		}
 
-	/*
-	 *	Free the rbtree
-	 */
-	talloc_free(state->tree);
+		/*
+		 *	Ensure we got *all* the entries
+		 */
+		rad_assert(!shard->head);
+
+		/*
+		 *	Free the rbtree
+		 */
+		talloc_free(shard->tree);
+	}
 
 	if (state == global_state) global_state = NULL;
 
@@ -172,13 +245,14 @@ static int _state_tree_free(fr_state_tree_t *state)
 /** Initialise a new state tree
  *
  * @param ctx to link the lifecycle of the state tree to.
- * @param max_sessions we track state for.
+ * @param max_sessions we track state for, over all the shards.
  * @param timeout How long to wait before cleaning up entries.
  * @return a new state tree or NULL on failure.
  */
 fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint32_t timeout)
 {
 	fr_state_tree_t *state;
+	int i;
 
 	state = talloc_zero(NULL, fr_state_tree_t);
 	if (!state) return 0;
@@ -186,6 +260,13 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint
 	state->max_sessions = max_sessions;
 	state->timeout = timeout;
 
+	state->memory = fr_memory_alloc(state, "state", "sessions");
+	if (!state->memory) {
+		talloc_free(state);
+		return NULL;
+	}
+	fr_memory_limits(state->memory, main_config.state_soft_limit, main_config.state_hard_limit);
+
 	/*
 	 *	Create a break in the contexts.
 	 *	We still want this to be freed at the same time
@@ -194,24 +275,31 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint
 	 *	tree.
 	 */
 	fr_talloc_link_ctx(ctx, state);
+	talloc_set_destructor(state, _state_tree_free);
 
-	if (main_config.spawn_workers && (pthread_mutex_init(&state->mutex, NULL) != 0)) {
-		talloc_free(state);
-		return NULL;
-	}
+	for (i = 0; i < STATE_TREE_SHARDS; i++) {
+		fr_state_shard_t *shard = &state->shard[i];
 
-	/*
-	 *	We need to do controlled freeing of the
-	 *	rbtree, so that all the state entries
-	 *	are freed before it's destroyed.  Hence
-	 *	it being parented from the NULL ctx.
-	 */
-	state->tree = rbtree_create(NULL, state_entry_cmp, NULL, 0);
-	if (!state->tree) {
-		talloc_free(state);
-		return NULL;
+		/*
+		 *	We need to do controlled freeing of the
+		 *	rbtree, so that all the state entries
+		 *	are freed before it's destroyed.  Hence
+		 *	it being parented from the NULL ctx.
+		 */
+		shard->tree = rbtree_create(NULL, state_entry_cmp, NULL, 0);
+		if (!shard->tree) {
+			talloc_free(state);
+			return NULL;
+		}
+
+		if (main_config.spawn_workers) {
+			if (pthread_mutex_init(&shard->mutex, NULL) != 0) {
+				talloc_free(state);
+				return NULL;
+			}
+			shard->mutex_init = true;
+		}
 	}
-	talloc_set_destructor(state, _state_tree_free);
 
 	return state;
 }
@@ -219,7 +307,7 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint
 /** Unlink an entry and remove if from the tree
  *
  */
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
+static void state_entry_unlink(fr_state_tree_t *state, fr_state_shard_t *shard, fr_state_entry_t *entry)
 {
 	fr_state_entry_t *prev, *next;
 
@@ -227,28 +315,154 @@ static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
 	next = entry->next;
 
 	if (prev) {
-		rad_assert(state->head != entry);
+		rad_assert(shard->head != entry);
 		prev->next = next;
-	} else if (state->head) {
-		rad_assert(state->head == entry);
-		state->head = next;
+	} else if (shard->head) {
+		rad_assert(shard->head == entry);
+		shard->head = next;
 	}
 
 	if (next) {
-		rad_assert(state->tail != entry);
+		rad_assert(shard->tail != entry);
 		next->prev = prev;
-	} else if (state->tail) {
-		rad_assert(state->tail == entry);
-		state->tail = prev;
+	} else if (shard->tail) {
+		rad_assert(shard->tail == entry);
+		shard->tail = prev;
 	}
 	entry->next = NULL;
 	entry->prev = NULL;
 
-	rbtree_deletebydata(state->tree, entry);
+	rbtree_deletebydata(shard->tree, entry);
+	atomic_fetch_sub_explicit(&state->num_entries, 1, memory_order_relaxed);
+
+	fr_memory_add(state->memory, -(int64_t) entry->size);
+	entry->size = 0;
 
 	DEBUG4("State ID %" PRIu64 " unlinked", entry->id);
 }
 
+/** Header for each VALUE_PAIR in a packed list
+ *
+ * Followed by the value, as written by fr_value_box_to_network().
+ */
+typedef struct {
+	fr_dict_attr_t const	*da;				//!< Attribute.  Dictionary attributes outlive
+								//!< state entries, so the pointer is stable.
+	uint32_t		len;				//!< Length of the value.
+	int8_t			tag;				//!< Tag of the VALUE_PAIR.
+	uint8_t			op;				//!< Operator of the VALUE_PAIR.
+	bool			tainted;			//!< Whether the value came from the network.
+} state_packed_pair_t;
+
+/** Pack a list of VALUE_PAIRs into a single buffer
+ *
+ * Lists containing VALUE_PAIRs which can't be packed (xlats, unknown attributes,
+ * or types with no network format) are left alone.
+ *
+ * @param[in] ctx	to allocate the buffer in.
+ * @param[in] vps	to pack.
+ * @return
+ *	- The packed VALUE_PAIRs.
+ *	- NULL if the list couldn't be packed.
+ */
+static uint8_t *state_pairs_pack(TALLOC_CTX *ctx, VALUE_PAIR *vps)
+{
+	VALUE_PAIR		*vp;
+	size_t			len = 0;
+	uint8_t			*packed, *p;
+	state_packed_pair_t	hdr;
+
+	for (vp = vps; vp; vp = vp->next) {
+		if ((vp->type != VT_DATA) || vp->da->flags.is_unknown || vp->da->flags.is_raw) return NULL;
+
+		switch (vp->vp_type) {
+		case FR_TYPE_TIMEVAL:
+		case FR_TYPE_SIZE:
+		case FR_TYPE_ABINARY:
+		case FR_TYPE_STRUCTURAL:
+			return NULL;
+
+		default:
+			break;
+		}
+
+		len += sizeof(hdr) + fr_value_box_network_length(&vp->data);
+	}
+
+	packed = p = talloc_array(ctx, uint8_t, len);
+	if (!packed) return NULL;
+
+	for (vp = vps; vp; vp = vp->next) {
+		ssize_t slen;
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.da = vp->da;
+		hdr.len = fr_value_box_network_length(&vp->data);
+		hdr.tag = vp->tag;
+		hdr.op = vp->op;
+		hdr.tainted = vp->data.tainted;
+
+		memcpy(p, &hdr, sizeof(hdr));
+		p += sizeof(hdr);
+
+		slen = fr_value_box_to_network(NULL, p, hdr.len, &vp->data);
+		if ((slen < 0) || ((size_t)slen != hdr.len)) {
+			talloc_free(packed);
+			return NULL;
+		}
+		p += slen;
+	}
+
+	return packed;
+}
+
+/** Unpack a buffer created by #state_pairs_pack
+ *
+ * @param[in] ctx	to allocate the VALUE_PAIRs in.
+ * @param[out] out	Where to write the list of VALUE_PAIRs.
+ * @param[in] packed	VALUE_PAIRs.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int state_pairs_unpack(TALLOC_CTX *ctx, VALUE_PAIR **out, uint8_t const *packed)
+{
+	uint8_t const		*p = packed, *end = packed + talloc_array_length(packed);
+	VALUE_PAIR		*head = NULL, **tail = &head;
+	state_packed_pair_t	hdr;
+
+	while (p < end) {
+		VALUE_PAIR *vp;
+
+		memcpy(&hdr, p, sizeof(hdr));
+		p += sizeof(hdr);
+
+		vp = fr_pair_afrom_da(ctx, hdr.da);
+		if (!vp) {
+		error:
+			fr_pair_list_free(&head);
+			return -1;
+		}
+		vp->tag = hdr.tag;
+		vp->op = hdr.op;
+
+		if (fr_value_box_from_network(vp, &vp->data, hdr.da->type, hdr.da,
+					      p, hdr.len, hdr.tainted) != (ssize_t)hdr.len) {
+			talloc_free(vp);
+			goto error;
+		}
+		vp->type = VT_DATA;
+		p += hdr.len;
+
+		*tail = vp;
+		tail = &vp->next;
+	}
+
+	*out = head;
+
+	return 0;
+}
+
 /** Frees any data associated with a state
  *
  */
@@ -287,99 +501,62 @@ static int _state_entry_free(fr_state_entry_t *entry)
 	return 0;
 }
 
-/** Create a new state entry
+/** Create a new state entry, and transfer the request's state to it
  *
- * @note Called with the mutex held.
+ * Expired entries in the shard the new entry goes into are cleaned
+ * up at the same time.
+ *
+ * @note Called with no mutexes held.
+ *
+ * @param[in] state tree to insert the entry into.
+ * @param[in] request to take the state from.
+ * @param[in] packet to add the State attribute to.
+ * @param[in] old_state the value of the previous State attribute, if any.
+ * @param[in] old_tries number of rounds so far.
+ * @param[in] data persistable request data.
+ * @return
+ *	- The new entry.
+ *	- NULL if the entry couldn't be created, or the tree is full.
  */
-static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *request,
-					    RADIUS_PACKET *packet, fr_state_entry_t *old)
+static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet,
+					    uint8_t const *old_state, int old_tries, request_data_t *data)
 {
-	size_t			i;
-	uint32_t		x;
 	time_t			now = time(NULL);
 	VALUE_PAIR		*vp;
-	fr_state_entry_t	*entry, *next;
+	fr_state_shard_t	*shard;
+	fr_state_entry_t	*entry, *this, *next;
 	fr_state_entry_t	*free_head = NULL, **free_next = &free_head;
-
-	uint8_t			old_state[sizeof(old->state)];
-	int			old_tries = 0;
+	uint8_t			*packed = NULL;
+	size_t			size;
+	int			evict = 0;
+	bool			over_limit = false;
 
 	/*
-	 *	Clean up old entries.
+	 *	Allocation doesn't need to occur inside the critical region
+	 *	and would add significantly to contention.
 	 */
-	for (entry = state->head; entry != NULL; entry = next) {
-		next = entry->next;
-
-		if (entry == old) continue;
-
-		/*
-		 *	Too old, we can delete it.
-		 */
-		if (entry->cleanup < now) {
-			state_entry_unlink(state, entry);
-			*free_next = entry;
-			free_next = &(entry->next);
-			state->timed_out++;
-			continue;
-		}
-
-		break;
-	}
-
-	if (rbtree_num_elements(state->tree) >= (uint32_t) state->max_sessions) return NULL;
+	entry = talloc_zero(NULL, fr_state_entry_t);
+	if (!entry) return NULL;
 
 	/*
-	 *	Record the information from the old state, we may base the
-	 *	new state off the old one.
-	 *
-	 *	Once we release the mutex, the state of old becomes indeterminate
-	 *	so we have to grab the values now.
+	 *	Packing is also done outside of the critical region.
+	 *	If the list can't be packed, the entry holds the
+	 *	VALUE_PAIRs as they are.
 	 */
-	if (old) {
-		old_tries = old->tries;
-
-		memcpy(old_state, old->state, sizeof(old_state));
-
-		/*
-		 *	The old one isn't used any more, so we can free it.
-		 */
-		if (!old->data) {
-			state_entry_unlink(state, old);
-			*free_next = old;
-		}
+	if (request->state) {
+		packed = state_pairs_pack(request->state_ctx, request->state);
+		if (packed) fr_pair_list_free(&request->state);
 	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
 
 	/*
-	 *	Now free the unlinked entries.
-	 *
-	 *	We do it here as freeing may involve significantly more
-	 *	work than just freeing the data.
-	 *
-	 *	If there's request data that was persisted it will now
-	 *	be freed also, and it may have complex destructors associated
-	 *	with it.
+	 *	The request owns the state_ctx, so it's safe to
+	 *	measure it here.
 	 */
-	for (next = free_head; next;) {
-		entry = next;
-		next = entry->next;
-		talloc_free(entry);
-	}
+	size = sizeof(*entry);
+	if (request->state_ctx) size += talloc_total_size(request->state_ctx);
 
-	/*
-	 *	Allocation doesn't need to occur inside the critical region
-	 *	and would add significantly to contention.
-	 *
-	 *	We reparent the talloc chunk later (when we hold the mutex again)
-	 *	we can't do it now due to thread safety issues with talloc.
-	 */
-	entry = talloc_zero(NULL, fr_state_entry_t);
-	if (!entry) {
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
-	}
 	talloc_set_destructor(entry, _state_entry_free);
-	entry->id = state->id++;
+	entry->id = atomic_fetch_add_explicit(&state->id, 1, memory_order_relaxed);
 
 	/*
 	 *	Limit the lifetime of this entry based on how long the
@@ -407,11 +584,8 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 		 *	16 octets of randomness should be enough to
 		 *	have a globally unique state.
 		 */
-		if (!old) {
-			for (i = 0; i < sizeof(entry->state) / sizeof(x); i++) {
-				x = fr_rand();
-				memcpy(entry->state + (i * 4), &x, sizeof(x));
-			}
+		if (!old_state) {
+			fr_rand_bytes(entry->state, sizeof(entry->state));
 		/*
 		 *	Base the new state on the old state if we had one.
 		 */
@@ -451,12 +625,6 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 		       entry->id, hex, (uint64_t)entry->cleanup - now);
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	if (rbtree_num_elements(state->tree) >= (uint32_t)state->max_sessions) {
-		talloc_free(entry);
-		return NULL;
-	}
-
 	/*
 	 *	XOR the server hash with four bytes of random data.
 	 *	We XOR is again before resolving, to ensure state lookups
@@ -465,52 +633,186 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 	 */
 	*((uint32_t *)(&entry->state_comp.server_hash)) ^= fr_hash_string(cf_section_name2(request->server_cs));
 
-	if (!rbtree_insert(state->tree, entry)) {
+	shard = state_shard(state, entry->state);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	/*
+	 *	Clean up old entries.
+	 */
+	for (this = shard->head; this != NULL; this = next) {
+		next = this->next;
+
+		/*
+		 *	Too old, we can delete it.
+		 */
+		if (this->cleanup < now) {
+			state_entry_unlink(state, shard, this);
+			*free_next = this;
+			free_next = &(this->next);
+			shard->timed_out++;
+			continue;
+		}
+
+		/*
+		 *	Over the soft limit, expire the oldest entries
+		 *	early.  Entries which have been restored to a
+		 *	request hold no memory, so they're left alone.
+		 */
+		if ((evict++ < STATE_EVICT_MAX) && (fr_memory_limit(state->memory) != FR_MEMORY_OK)) {
+			if (!this->size) continue;
+
+			state_entry_unlink(state, shard, this);
+			*free_next = this;
+			free_next = &(this->next);
+			continue;
+		}
+
+		break;
+	}
+
+	/*
+	 *	A module may have put the old State value back into
+	 *	the reply, in which case the new entry replaces the
+	 *	old one.
+	 */
+	if (old_state && (memcmp(entry->state, old_state, sizeof(entry->state)) == 0)) {
+		this = state_entry_find(shard, entry);
+		if (this && !this->data) {
+			state_entry_unlink(state, shard, this);
+			*free_next = this;
+			free_next = &(this->next);
+		}
+	}
+
+	/*
+	 *	The limit is on all of the shards together, as a
+	 *	fixed share each would refuse sessions whenever one
+	 *	shard got more than its share.  Later rounds of a
+	 *	session are let through, as their old entry is still
+	 *	counted until they have a new one.
+	 */
+	if ((atomic_fetch_add_explicit(&state->num_entries, 1, memory_order_relaxed) >= state->max_sessions) &&
+	    !old_state) {
+	refuse:
+		atomic_fetch_sub_explicit(&state->num_entries, 1, memory_order_relaxed);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 		talloc_free(entry);
-		return NULL;
+		entry = NULL;
+		goto done;
+	}
+
+	/*
+	 *	New sessions are refused over the hard limit.  Later
+	 *	rounds of a session are let through, otherwise the
+	 *	rounds so far would have been wasted.
+	 */
+	if (!old_state) {
+		if (!fr_memory_reserve(state->memory, size)) {
+			over_limit = true;
+			goto refuse;
+		}
+	} else {
+		fr_memory_add(state->memory, size);
 	}
 
+	if (!rbtree_insert(shard->tree, entry)) {
+		fr_memory_add(state->memory, -(int64_t) size);
+		goto refuse;
+	}
+	entry->size = size;
+
 	/*
 	 *	Link it to the end of the list, which is implicitely
 	 *	ordered by cleanup time.
 	 */
-	if (!state->head) {
+	if (!shard->head) {
 		entry->prev = entry->next = NULL;
-		state->head = state->tail = entry;
+		shard->head = shard->tail = entry;
 	} else {
-		rad_assert(state->tail != NULL);
+		rad_assert(shard->tail != NULL);
 
-		entry->prev = state->tail;
-		state->tail->next = entry;
+		entry->prev = shard->tail;
+		shard->tail->next = entry;
 
 		entry->next = NULL;
-		state->tail = entry;
+		shard->tail = entry;
+	}
+
+	rad_assert(request->state_ctx);
+
+	entry->seq_start = request->seq_start;
+	entry->ctx = request->state_ctx;
+	entry->vps = request->state;
+	entry->packed = packed;
+	entry->data = data;
+
+	request->state_ctx = NULL;
+	request->state = NULL;
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+done:
+	if (over_limit) RWARN("Not saving &session-state, its memory is over memory.state.hard_limit");
+
+	/*
+	 *	Now free the unlinked entries.
+	 *
+	 *	We do it here as freeing may involve significantly more
+	 *	work than just freeing the data.
+	 *
+	 *	If there's request data that was persisted it will now
+	 *	be freed also, and it may have complex destructors associated
+	 *	with it.
+	 */
+	for (next = free_head; next;) {
+		this = next;
+		next = this->next;
+		talloc_free(this);
 	}
 
 	return entry;
 }
 
-/** Find the entry, based on the State attribute
+/** Get the key to lookup an entry, based on the State attribute
  *
+ * @param[out] key to pass to #state_entry_find.
+ * @param[in] state tree to search.
+ * @param[in] request the packet was received in.
+ * @param[in] packet containing the State attribute.
+ * @return
+ *	- The shard the entry would be in.
+ *	- NULL if the packet has no usable State attribute.
  */
-static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet)
+static fr_state_shard_t *state_entry_key(fr_state_entry_t *key, fr_state_tree_t *state,
+					 REQUEST *request, RADIUS_PACKET *packet)
 {
 	VALUE_PAIR *vp;
-	fr_state_entry_t *entry, my_entry;
 
 	vp = fr_pair_find_by_num(packet->vps, 0, FR_STATE, TAG_ANY);
 	if (!vp) return NULL;
 
-	if (vp->vp_length != sizeof(my_entry.state)) return NULL;
+	if (vp->vp_length != sizeof(key->state)) return NULL;
 
-	memcpy(my_entry.state, vp->vp_octets, sizeof(my_entry.state));
+	memcpy(key->state, vp->vp_octets, sizeof(key->state));
 
 	/*
 	 *	Make it unique for different virtual servers handling the same request
 	 */
-	my_entry.state_comp.server_hash ^= fr_hash_string(cf_section_name2(request->server_cs));
+	key->state_comp.server_hash ^= fr_hash_string(cf_section_name2(request->server_cs));
 
-	entry = rbtree_finddata(state->tree, &my_entry);
+	return state_shard(state, key->state);
+}
+
+/** Find the entry, based on the State attribute
+ *
+ * @note Called with the mutex of the shard held.
+ */
+static fr_state_entry_t *state_entry_find(fr_state_shard_t *shard, fr_state_entry_t const *key)
+{
+	fr_state_entry_t *entry;
+
+	entry = rbtree_finddata(shard->tree, key);
 
 	if (entry) (void) talloc_get_type_abort(entry, fr_state_entry_t);
 
@@ -522,16 +824,26 @@ static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, REQUEST *reque
  */
 void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *original)
 {
-	fr_state_entry_t *entry;
+	fr_state_shard_t *shard;
+	fr_state_entry_t *entry, my_entry;
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	entry = state_entry_find(state, request, original);
+	shard = state_entry_key(&my_entry, state, request, original);
+	if (!shard) return;
+
+	/*
+	 *	The entry may have been restored from the
+	 *	copy, so there may be no local entry.
+	 */
+	if (state_backend) state_backend->discard(request, my_entry.state, state_backend->uctx);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = state_entry_find(shard, &my_entry);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 		return;
 	}
-	state_entry_unlink(state, entry);
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	state_entry_unlink(state, shard, entry);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
 	/*
 	 *	The state and request must be in the same state
@@ -540,6 +852,7 @@ void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *o
 	 */
 	entry->ctx = request->state_ctx;
 	entry->vps = request->state;
+	entry->packed = NULL;
 	request_data_by_persistance(&entry->data, request, true);
 
 	request->state_ctx = NULL;
@@ -560,8 +873,10 @@ void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *o
  */
 void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet)
 {
-	fr_state_entry_t *entry;
+	fr_state_shard_t *shard;
+	fr_state_entry_t *entry, my_entry;
 	TALLOC_CTX *old_ctx = NULL;
+	uint8_t *packed = NULL;
 
 	rad_assert(request->state == NULL);
 
@@ -574,23 +889,53 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 		return;
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
+	shard = state_entry_key(&my_entry, state, request, packet);
+	if (!shard) goto done;
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
 
-	entry = state_entry_find(state, request, packet);
+	entry = state_entry_find(shard, &my_entry);
+	FR_PROBE2(state_lookup, request->number, (entry != NULL));
 	if (entry) {
 		if (request->state_ctx) old_ctx = request->state_ctx;
 
 		request->seq_start = entry->seq_start;
 		request->state_ctx = entry->ctx;
 		request->state = entry->vps;
+		packed = entry->packed;
 		request_data_restore(request, entry->data);
 
 		entry->ctx = NULL;
 		entry->vps = NULL;
+		entry->packed = NULL;
 		entry->data = NULL;
+
+		fr_memory_add(state->memory, -(int64_t) entry->size);
+		entry->size = 0;
 	}
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	/*
+	 *	Record the miss, so that the backend can
+	 *	look for a copy written by another server.
+	 */
+	if (!entry && state_backend) {
+		uint8_t *key;
+
+		MEM(key = talloc_memdup(NULL, my_entry.state, sizeof(my_entry.state)));
+		if (request_data_add(request, state, 0, key, true, true, false) < 0) talloc_free(key);
+	}
+
+	/*
+	 *	Unpacking is done outside of the mutex, too.
+	 */
+	if (packed) {
+		if (state_pairs_unpack(request->state_ctx, &request->state, packed) < 0) {
+			RPERROR("Failed unpacking &session-state");
+		}
+		talloc_free(packed);
+	}
 
 	if (request->state) {
 		RDEBUG2("Restored &session-state");
@@ -602,6 +947,7 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 	 */
 	if (old_ctx) talloc_free(old_ctx);
 
+done:
 	RDEBUG3("RADIUS State - restored");
 
 	VERIFY_REQUEST(request);
@@ -618,9 +964,17 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
  */
 bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *original, RADIUS_PACKET *packet)
 {
-	fr_state_entry_t *entry, *old;
+	fr_state_shard_t *shard;
+	fr_state_entry_t *old = NULL, old_key, my_entry;
 	request_data_t *data;
 
+	uint8_t old_state[sizeof(my_entry.state)];
+	int old_tries = 0;
+	bool found = false, have_key;
+
+	uint8_t *record = NULL;
+	ssize_t record_len = 0;
+
 	request_data_by_persistance(&data, request, true);
 
 	if (!request->state && !data) return true;
@@ -630,29 +984,92 @@ bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 		rdebug_pair_list(L_DBG_LVL_2, request, request->state, "&session-state:");
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
+	/*
+	 *	Record the information from the old state, we may base the
+	 *	new state off the old one.
+	 *
+	 *	Once we release the mutex, the state of old becomes indeterminate
+	 *	so we have to grab the values now.
+	 */
+	shard = original ? state_entry_key(&old_key, state, request, original) : NULL;
+	if (shard) {
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		old = state_entry_find(shard, &old_key);
+		if (old) {
+			found = true;
+			old_tries = old->tries;
+
+			memcpy(old_state, old->state, sizeof(old_state));
+		}
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
 
-	old = original ? state_entry_find(state, request, original) :
-			 NULL;
+	/*
+	 *	The entry takes the VALUE_PAIRs, so the copy
+	 *	has to be written first.
+	 */
+	if (state_backend && request->state) {
+		fr_detail_record_t rec = {
+			.code = request->packet->code,
+			.timestamp = request->packet->timestamp,
+			.src_ipaddr = request->packet->src_ipaddr,
+			.dst_ipaddr = request->packet->dst_ipaddr,
+			.src_port = request->packet->src_port,
+			.dst_port = request->packet->dst_port
+		};
+
+		record_len = fr_detail_binary_encode(request, &record, &rec, request->state, NULL, NULL);
+		if (record_len < 0) RWARN("Not copying &session-state: %s", fr_strerror());
+	}
 
-	entry = state_entry_create(state, request, packet, old);
-	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	/*
+	 *	If we can't create the new entry, the old one is left
+	 *	alone, so the session can still carry on from it.
+	 */
+	if (!state_entry_create(state, request, packet, found ? old_state : NULL, old_tries, data)) {
+		talloc_free(record);
 		return false;
 	}
 
-	rad_assert(entry->ctx == NULL);
-	rad_assert(request->state_ctx);
+	/*
+	 *	The key is the same as the entry's, but the entry
+	 *	may already have been freed by another thread.
+	 */
+	have_key = (state_entry_key(&my_entry, state, request, packet) != NULL);
 
-	entry->seq_start = request->seq_start;
-	entry->ctx = request->state_ctx;
-	entry->vps = request->state;
-	entry->data = data;
+	/*
+	 *	Now the session has its new entry, the old one isn't
+	 *	used any more, so we can free it.  If the new entry
+	 *	has the same State value, it has already replaced the
+	 *	old one.
+	 */
+	if (shard && (!have_key || (memcmp(my_entry.state, old_key.state, sizeof(my_entry.state)) != 0))) {
+		if (found) {
+			PTHREAD_MUTEX_LOCK(&shard->mutex);
+			old = state_entry_find(shard, &old_key);
+			if (old && !old->data) {
+				state_entry_unlink(state, shard, old);
+			} else {
+				old = NULL;
+			}
+			PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
-	request->state_ctx = NULL;
-	request->state = NULL;
+			/*
+			 *	Free this outside of the mutex for less contention.
+			 */
+			talloc_free(old);
+		}
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		if (state_backend) state_backend->discard(request, old_key.state, state_backend->uctx);
+	}
+
+	if (record_len > 0) {
+		if (have_key) {
+			state_backend->store(request, my_entry.state, record, record_len,
+					     state->timeout, state_backend->uctx);
+		}
+		talloc_free(record);
+	}
 
 	RDEBUG3("RADIUS State - saved");
 	VERIFY_REQUEST(request);
@@ -660,12 +1077,96 @@ bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 	return true;
 }
 
+/** Set the backend which copies entries to storage shared with other servers
+ *
+ * Must be called before any worker starts.
+ *
+ * @param[in] backend	to use, or NULL to stop copying entries.  Must not be
+ *			freed until it's unregistered.
+ * @return
+ *	- 0 on success.
+ *	- -1 if another backend is already registered.
+ */
+int fr_state_backend_register(fr_state_backend_t const *backend)
+{
+	if (backend && state_backend && (backend != state_backend)) {
+		fr_strerror_printf("Another module is already copying &session-state");
+		return -1;
+	}
+
+	state_backend = backend;
+
+	return 0;
+}
+
+/** Check whether the request had a State value with no local entry
+ *
+ * The miss is only recorded if a backend is registered.  Each miss is
+ * returned once.
+ *
+ * @param[in] state	tree which was searched.
+ * @param[out] key	of the entry which wasn't found, #FR_STATE_KEY_LEN bytes.
+ * @param[in] request	to check.
+ * @return
+ *	- true if the entry wasn't found, and its copy should be fetched.
+ *	- false if there was no State value, or the entry was found.
+ */
+bool fr_state_missed(fr_state_tree_t *state, uint8_t *key, REQUEST *request)
+{
+	uint8_t *missed;
+
+	missed = request_data_get(request, state, 0);
+	if (!missed) return false;
+
+	memcpy(key, missed, FR_STATE_KEY_LEN);
+	talloc_free(missed);
+
+	return true;
+}
+
+/** Restore &session-state from a copy written by #fr_state_backend_t.store
+ *
+ * The next round creates an entry on this server, as if the session had
+ * started here.
+ *
+ * @param[in] state	tree the entry would have been in.
+ * @param[in] request	to restore the VALUE_PAIRs into.
+ * @param[in] data	the copy.
+ * @param[in] data_len	length of the copy.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the copy is damaged.
+ */
+int fr_state_restore(UNUSED fr_state_tree_t *state, REQUEST *request, uint8_t const *data, size_t data_len)
+{
+	fr_detail_record_t	rec;
+	VALUE_PAIR		*vps = NULL;
+	int			skipped;
+
+	if (fr_detail_binary_check(data, data_len) != (ssize_t) data_len) {
+		fr_strerror_printf_push("Invalid &session-state copy");
+		return -1;
+	}
+
+	skipped = fr_detail_binary_decode(request->state_ctx, &rec, &vps, data, data_len);
+	if (skipped < 0) return -1;
+	if (skipped > 0) RWDEBUG("Skipped %i unknown attribute(s) in &session-state copy", skipped);
+
+	fr_pair_add(&request->state, vps);
+	if (!request->seq_start) request->seq_start = request->number;
+
+	RDEBUG2("Restored &session-state from copy");
+	rdebug_pair_list(L_DBG_LVL_2, request, request->state, "&session-state:");
+
+	return 0;
+}
+
 /** Return number of entries created
  *
  */
 uint64_t fr_state_entries_created(fr_state_tree_t *state)
 {
-	return state->id;
+	return atomic_load_explicit(&state->id, memory_order_relaxed);
 }
 
 /** Return number of entries that timed out
@@ -673,7 +1174,12 @@ uint64_t fr_state_entries_created(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
 {
-	return state->timed_out;
+	uint64_t timed_out = 0;
+	int i;
+
+	for (i = 0; i < STATE_TREE_SHARDS; i++) timed_out += state->shard[i].timed_out;
+
+	return timed_out;
 }
 
 /** Return number of entries we're currently tracking
@@ -681,5 +1187,5 @@ uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
  */
 uint32_t fr_state_entries_tracked(fr_state_tree_t *state)
 {
-	return (uint32_t)rbtree_num_elements(state->tree);
+	return atomic_load_explicit(&state->num_entries, memory_order_relaxed);
 }
@@ -25,6 +25,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/io/time.h>
 
 #ifdef WITH_STATS
 
@@ -35,31 +36,232 @@ RCSID("$Id$")
 static struct timeval	start_time;
 static struct timeval	hup_time;
 
-#define FR_STATS_INIT { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 	\
-				 { 0, 0, 0, 0, 0, 0, 0, 0 }}
-
-fr_stats_t radius_auth_stats = FR_STATS_INIT;
-#ifdef WITH_ACCOUNTING
-fr_stats_t radius_acct_stats = FR_STATS_INIT;
-#endif
-#ifdef WITH_COA
-fr_stats_t radius_coa_stats = FR_STATS_INIT;
-fr_stats_t radius_dsc_stats = FR_STATS_INIT;
-#endif
+/*
+ *	The counters are kept per thread, so that threads counting
+ *	the same thing don't fight over the cache lines holding the
+ *	counters.  They're only added up when someone reads them.
+ *
+ *	Each thing which is counted (the server, a client, a listener,
+ *	a home server) has an ID, which is allocated the first time
+ *	it's counted.  Each thread has an array of counters, indexed by
+ *	the ID.  IDs aren't re-used, so the arrays grow when dynamic
+ *	clients come and go.
+ */
+#define STATS_CACHE_LINE	(64)
+#define STATS_ID_FIRST		(3)	//!< IDs below this are the global counters.
 
+uint32_t radius_stats_server = 1;
 #ifdef WITH_PROXY
-fr_stats_t proxy_auth_stats = FR_STATS_INIT;
-#ifdef WITH_ACCOUNTING
-fr_stats_t proxy_acct_stats = FR_STATS_INIT;
-#endif
-#ifdef WITH_COA
-fr_stats_t proxy_coa_stats = FR_STATS_INIT;
-fr_stats_t proxy_dsc_stats = FR_STATS_INIT;
-#endif
+uint32_t radius_stats_proxy = 2;
 #endif
 
+/** The counters of one thread
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< In the list of all shards.
+	pthread_mutex_t		mutex;		//!< Held when the counters are resized, or read.
+	void			*mem;		//!< Which "stats" points into.
+	fr_stats_t		*stats;		//!< Indexed by (id * RADIUS_STATS_TYPE_MAX) + type.
+	uint32_t		num;		//!< Number of IDs in "stats".
+} radius_stats_shard_t;
+
+static pthread_mutex_t		stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_dlist_t		stats_shards = { &stats_shards, &stats_shards };
+static uint32_t			stats_id_next = STATS_ID_FIRST;
+
+/*
+ *	Holds the counters of threads which have exited.
+ */
+static radius_stats_shard_t	stats_retired = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+fr_thread_local_setup(radius_stats_shard_t *, radius_stats_shard)
+
+/** Add one set of counters to another
+ *
+ */
+static void stats_add(fr_stats_t *out, fr_stats_t const *in)
+{
+	int i;
+
+	out->total_requests += in->total_requests;
+	out->total_invalid_requests += in->total_invalid_requests;
+	out->total_dup_requests += in->total_dup_requests;
+	out->total_responses += in->total_responses;
+	out->total_access_accepts += in->total_access_accepts;
+	out->total_access_rejects += in->total_access_rejects;
+	out->total_access_challenges += in->total_access_challenges;
+	out->total_malformed_requests += in->total_malformed_requests;
+	out->total_bad_authenticators += in->total_bad_authenticators;
+	out->total_packets_dropped += in->total_packets_dropped;
+	out->total_no_records += in->total_no_records;
+	out->total_unknown_types += in->total_unknown_types;
+	out->total_timeouts += in->total_timeouts;
+	if (in->last_packet > out->last_packet) out->last_packet = in->last_packet;
+
+	for (i = 0; i < 8; i++) out->elapsed[i] += in->elapsed[i];
+}
+
+/** Make a shard big enough to hold an ID
+ *
+ * The new counters are aligned to a cache line, and padded out to
+ * one, so that they don't share a line with anyone else's memory.
+ *
+ * @note Must be called with the shard's mutex held, if other threads
+ *	can see the shard.
+ */
+static int stats_shard_grow(radius_stats_shard_t *shard, uint32_t id)
+{
+	uint32_t	num;
+	size_t		size;
+	void		*mem;
+	fr_stats_t	*stats;
+
+	num = shard->num ? shard->num : 16;
+	while (num <= id) num *= 2;
+
+	size = num * RADIUS_STATS_TYPE_MAX * sizeof(fr_stats_t);
+	mem = talloc_zero_size(NULL, size + (2 * STATS_CACHE_LINE));
+	if (!mem) return -1;
+
+	stats = (fr_stats_t *) ((((uintptr_t) mem) + STATS_CACHE_LINE - 1) & ~((uintptr_t) STATS_CACHE_LINE - 1));
+	if (shard->stats) memcpy(stats, shard->stats, shard->num * RADIUS_STATS_TYPE_MAX * sizeof(fr_stats_t));
+
+	talloc_free(shard->mem);
+	shard->mem = mem;
+	shard->stats = stats;
+	shard->num = num;
+
+	return 0;
+}
+
+/** Fold the counters of an exiting thread into the retired counters
+ *
+ */
+static void _stats_shard_free(void *arg)
+{
+	radius_stats_shard_t	*shard = talloc_get_type_abort(arg, radius_stats_shard_t);
+	uint32_t		i;
+
+	pthread_mutex_lock(&stats_mutex);
+	fr_dlist_remove(&shard->entry);
+
+	pthread_mutex_lock(&stats_retired.mutex);
+	if ((shard->num > stats_retired.num) && (stats_shard_grow(&stats_retired, shard->num - 1) < 0)) {
+		shard->num = stats_retired.num;	/* lose what we can't keep */
+	}
+	for (i = 0; i < (shard->num * RADIUS_STATS_TYPE_MAX); i++) {
+		stats_add(&stats_retired.stats[i], &shard->stats[i]);
+	}
+	pthread_mutex_unlock(&stats_retired.mutex);
+	pthread_mutex_unlock(&stats_mutex);
+
+	pthread_mutex_destroy(&shard->mutex);
+	talloc_free(shard);
+}
+
+/** Return this thread's counters for something
+ *
+ * The counters may only be updated by the calling thread, and only
+ * until it next calls this function.
+ *
+ * @param[in,out] id	of the thing being counted.  If zero, an ID is allocated.
+ * @param[in] type	of the counters.
+ * @return the counters.
+ */
+fr_stats_t *radius_stats_local(uint32_t *id, radius_stats_type_t type)
+{
+	radius_stats_shard_t	*shard = radius_stats_shard;
+	static fr_stats_t	dummy;
+
+	if (!*id) {
+		pthread_mutex_lock(&stats_mutex);
+		if (!*id) *id = stats_id_next++;
+		pthread_mutex_unlock(&stats_mutex);
+	}
+
+	if (!shard) {
+		shard = talloc_zero(NULL, radius_stats_shard_t);
+		if (!shard) return &dummy;
+
+		pthread_mutex_init(&shard->mutex, NULL);
+		if (stats_shard_grow(shard, *id) < 0) {
+			talloc_free(shard);
+			return &dummy;
+		}
+
+		pthread_mutex_lock(&stats_mutex);
+		fr_dlist_insert_tail(&stats_shards, &shard->entry);
+		pthread_mutex_unlock(&stats_mutex);
+
+		fr_thread_local_set_destructor(radius_stats_shard, _stats_shard_free, shard);
+
+	} else if (*id >= shard->num) {
+		int ret;
+
+		pthread_mutex_lock(&shard->mutex);
+		ret = stats_shard_grow(shard, *id);
+		pthread_mutex_unlock(&shard->mutex);
+		if (ret < 0) return &dummy;
+	}
+
+	return &shard->stats[(*id * RADIUS_STATS_TYPE_MAX) + type];
+}
+
+/** Add up the counters of all threads for something
+ *
+ * @param[out] out	where the totals are written.
+ * @param[in] id	of the thing being counted.
+ * @param[in] type	of the counters.
+ */
+void radius_stats_read(fr_stats_t *out, uint32_t const *id, radius_stats_type_t type)
+{
+	fr_dlist_t		*entry;
+	uint32_t		i = *id;
+
+	memset(out, 0, sizeof(*out));
+	if (!i) return;		/* never counted */
+
+	pthread_mutex_lock(&stats_mutex);
+	for (entry = FR_DLIST_FIRST(stats_shards);
+	     entry;
+	     entry = FR_DLIST_NEXT(stats_shards, entry)) {
+		radius_stats_shard_t *shard = fr_ptr_to_type(radius_stats_shard_t, entry, entry);
+
+		pthread_mutex_lock(&shard->mutex);
+		if (i < shard->num) stats_add(out, &shard->stats[(i * RADIUS_STATS_TYPE_MAX) + type]);
+		pthread_mutex_unlock(&shard->mutex);
+	}
+
+	pthread_mutex_lock(&stats_retired.mutex);
+	if (i < stats_retired.num) stats_add(out, &stats_retired.stats[(i * RADIUS_STATS_TYPE_MAX) + type]);
+	pthread_mutex_unlock(&stats_retired.mutex);
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+/** This thread's counters for a request
+ *
+ */
+typedef struct {
+	fr_stats_t	*server;
+	fr_stats_t	*listener;
+	fr_stats_t	*client;
+} stats_request_t;
+
+static inline void stats_request(stats_request_t *out, REQUEST *request, radius_stats_type_t type)
+{
+	out->server = radius_stats_local(&radius_stats_server, type);
+	out->listener = radius_stats_local(&request->listener->stats_id, type);
+	out->client = radius_stats_local(&request->client->stats_id, type);
+}
+
 void request_stats_final(REQUEST *request)
 {
+	stats_request_t	local;
+#ifdef WITH_PROXY
+	fr_stats_t	*proxy, *home;
+#endif
+
 	if (request->master_state == REQUEST_COUNTED) return;
 
 	if (!request->listener) return;
@@ -79,37 +281,51 @@ void request_stats_final(REQUEST *request)
 	if (request->packet->code == FR_CODE_STATUS_SERVER)
 		return;
 
+#undef STATS_INC
+#define STATS_INC(_t, _x) do { \
+	stats_request(&local, request, _t); \
+	local.server->_x++; \
+	local.listener->_x++; \
+	local.client->_x++; \
+} while (0)
+
 #undef INC_AUTH
-#define INC_AUTH(_x) radius_auth_stats._x++;request->listener->stats._x++;request->client->auth._x++;
+#define INC_AUTH(_x) STATS_INC(RADIUS_STATS_AUTH, _x)
 
 #undef INC_ACCT
 #ifdef WITH_ACCOUNTING
-#define INC_ACCT(_x) radius_acct_stats._x++;request->listener->stats._x++;request->client->acct._x++
+#define INC_ACCT(_x) STATS_INC(RADIUS_STATS_ACCT, _x)
 #else
 #define INC_ACCT(_x)
 #endif
 
 #undef INC_COA
 #ifdef WITH_COA
-#define INC_COA(_x) radius_coa_stats._x++;request->listener->stats._x++;request->client->coa._x++
+#define INC_COA(_x) STATS_INC(RADIUS_STATS_COA, _x)
 #else
 #define INC_COA(_x)
 #endif
 
 #undef INC_DSC
 #ifdef WITH_DSC
-#define INC_DSC(_x) radius_dsc_stats._x++;request->listener->stats._x++;request->client->dsc._x++
+#define INC_DSC(_x) STATS_INC(RADIUS_STATS_DSC, _x)
 #else
 #define INC_DSC(_x)
 #endif
 
+#undef STATS_BINS
+#define STATS_BINS do { \
+	fr_stats_bins(local.server, &request->packet->timestamp, &request->reply->timestamp); \
+	fr_stats_bins(local.client, &request->packet->timestamp, &request->reply->timestamp); \
+	fr_stats_bins(local.listener, &request->packet->timestamp, &request->reply->timestamp); \
+} while (0)
+
 	/*
 	 *	Update the statistics.
 	 *
-	 *	Note that we do NOT do this in a child thread.
-	 *	Instead, we update the stats when a request is
-	 *	deleted, because only the main server thread calls
-	 *	this function, which makes it thread-safe.
+	 *	The counters belong to this thread, so we don't need
+	 *	locks, and we don't share cache lines with any other
+	 *	thread.
 	 */
 	if (request->reply && (request->packet->code != FR_CODE_STATUS_SERVER)) switch (request->reply->code) {
 	case FR_CODE_ACCESS_ACCEPT:
@@ -121,15 +337,7 @@ void request_stats_final(REQUEST *request)
 		/*
 		 *	FIXME: Do the time calculations once...
 		 */
-		fr_stats_bins(&radius_auth_stats,
-			      &request->packet->timestamp,
-			      &request->reply->timestamp);
-		fr_stats_bins(&request->client->auth,
-			      &request->packet->timestamp,
-			      &request->reply->timestamp);
-		fr_stats_bins(&request->listener->stats,
-			      &request->packet->timestamp,
-			      &request->reply->timestamp);
+		STATS_BINS;
 		break;
 
 	case FR_CODE_ACCESS_REJECT:
@@ -143,10 +351,10 @@ void request_stats_final(REQUEST *request)
 #ifdef WITH_ACCOUNTING
 	case FR_CODE_ACCOUNTING_RESPONSE:
 		INC_ACCT(total_responses);
-		fr_stats_bins(&radius_acct_stats,
+		fr_stats_bins(local.server,
 			      &request->packet->timestamp,
 			      &request->reply->timestamp);
-		fr_stats_bins(&request->client->acct,
+		fr_stats_bins(local.client,
 			      &request->packet->timestamp,
 			      &request->reply->timestamp);
 		break;
@@ -157,7 +365,7 @@ void request_stats_final(REQUEST *request)
 		INC_COA(total_access_accepts);
 	  coa_stats:
 		INC_COA(total_responses);
-		fr_stats_bins(&request->client->coa,
+		fr_stats_bins(local.client,
 			      &request->packet->timestamp,
 			      &request->reply->timestamp);
 		break;
@@ -170,7 +378,7 @@ void request_stats_final(REQUEST *request)
 		INC_DSC(total_access_accepts);
 	  dsc_stats:
 		INC_DSC(total_responses);
-		fr_stats_bins(&request->client->dsc,
+		fr_stats_bins(local.client,
 			      &request->packet->timestamp,
 			      &request->reply->timestamp);
 		break;
@@ -237,47 +445,50 @@ void request_stats_final(REQUEST *request)
 
 	switch (request->proxy->packet->code) {
 	case FR_CODE_ACCESS_REQUEST:
-		proxy_auth_stats.total_requests += request->proxy->packet->count;
-		request->proxy->home_server->stats.total_requests += request->proxy->packet->count;
+		proxy = radius_stats_local(&radius_stats_proxy, RADIUS_STATS_AUTH);
+		home = radius_stats_local(&request->proxy->home_server->stats_id, RADIUS_STATS_AUTH);
 		break;
 
 #ifdef WITH_ACCOUNTING
 	case FR_CODE_ACCOUNTING_REQUEST:
-		proxy_acct_stats.total_requests += request->proxy->packet->count;
-		request->proxy->home_server->stats.total_requests += request->proxy->packet->count;
+		proxy = radius_stats_local(&radius_stats_proxy, RADIUS_STATS_ACCT);
+		home = radius_stats_local(&request->proxy->home_server->stats_id, RADIUS_STATS_ACCT);
 		break;
 #endif
 
 #ifdef WITH_COA
 	case FR_CODE_COA_REQUEST:
-		proxy_coa_stats.total_requests += request->proxy->packet->count;
-		request->proxy->home_server->stats.total_requests += request->proxy->packet->count;
+		proxy = radius_stats_local(&radius_stats_proxy, RADIUS_STATS_COA);
+		home = radius_stats_local(&request->proxy->home_server->stats_id, RADIUS_STATS_COA);
 		break;
 
 	case FR_CODE_DISCONNECT_REQUEST:
-		proxy_dsc_stats.total_requests += request->proxy->packet->count;
-		request->proxy->home_server->stats.total_requests += request->proxy->packet->count;
+		proxy = radius_stats_local(&radius_stats_proxy, RADIUS_STATS_DSC);
+		home = radius_stats_local(&request->proxy->home_server->stats_id, RADIUS_STATS_DSC);
 		break;
 #endif
 
 	default:
-		break;
+		goto done;
 	}
 
+	proxy->total_requests += request->proxy->packet->count;
+	home->total_requests += request->proxy->packet->count;
+
 	if (!request->proxy->reply) goto done;	/* simplifies formatting */
 
 #undef INC
-#define INC(_x) proxy_auth_stats._x += request->proxy->reply->count; request->proxy->home_server->stats._x += request->proxy->reply->count;
+#define INC(_x) proxy->_x += request->proxy->reply->count; home->_x += request->proxy->reply->count;
 
 	switch (request->proxy->reply->code) {
 	case FR_CODE_ACCESS_ACCEPT:
 		INC(total_access_accepts);
 	proxy_stats:
 		INC(total_responses);
-		fr_stats_bins(&proxy_auth_stats,
+		fr_stats_bins(proxy,
 			      &request->proxy->packet->timestamp,
 			      &request->proxy->reply->timestamp);
-		fr_stats_bins(&request->proxy->home_server->stats,
+		fr_stats_bins(home,
 			      &request->proxy->packet->timestamp,
 			      &request->proxy->reply->timestamp);
 		break;
@@ -292,46 +503,26 @@ void request_stats_final(REQUEST *request)
 
 #ifdef WITH_ACCOUNTING
 	case FR_CODE_ACCOUNTING_RESPONSE:
-		proxy_acct_stats.total_responses++;
-		request->proxy->home_server->stats.total_responses++;
-		fr_stats_bins(&proxy_acct_stats,
-			      &request->proxy->packet->timestamp,
-			      &request->proxy->reply->timestamp);
-		fr_stats_bins(&request->proxy->home_server->stats,
-			      &request->proxy->packet->timestamp,
-			      &request->proxy->reply->timestamp);
-		break;
 #endif
-
 #ifdef WITH_COA
 	case FR_CODE_COA_ACK:
 	case FR_CODE_COA_NAK:
-		proxy_coa_stats.total_responses++;
-		request->proxy->home_server->stats.total_responses++;
-		fr_stats_bins(&proxy_coa_stats,
-			      &request->proxy->packet->timestamp,
-			      &request->proxy->reply->timestamp);
-		fr_stats_bins(&request->proxy->home_server->stats,
-			      &request->proxy->packet->timestamp,
-			      &request->proxy->reply->timestamp);
-		break;
-
 	case FR_CODE_DISCONNECT_ACK:
 	case FR_CODE_DISCONNECT_NAK:
-		proxy_dsc_stats.total_responses++;
-		request->proxy->home_server->stats.total_responses++;
-		fr_stats_bins(&proxy_dsc_stats,
+#endif
+		proxy->total_responses++;
+		home->total_responses++;
+		fr_stats_bins(proxy,
 			      &request->proxy->packet->timestamp,
 			      &request->proxy->reply->timestamp);
-		fr_stats_bins(&request->proxy->home_server->stats,
+		fr_stats_bins(home,
 			      &request->proxy->packet->timestamp,
 			      &request->proxy->reply->timestamp);
 		break;
-#endif
 
 	default:
-		proxy_auth_stats.total_unknown_types++;
-		request->proxy->home_server->stats.total_unknown_types++;
+		proxy->total_unknown_types++;
+		home->total_unknown_types++;
 		break;
 	}
 
@@ -461,6 +652,7 @@ static void request_stats_addvp(REQUEST *request,
 void request_stats_reply(REQUEST *request)
 {
 	VALUE_PAIR *flag, *vp;
+	fr_stats_t stats;
 
 	/*
 	 *	Statistics are available ONLY on a "status" port.
@@ -476,7 +668,8 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_uint32 & 0x01) != 0) &&
 	    ((flag->vp_uint32 & 0xc0) == 0)) {
-		request_stats_addvp(request, authvp, &radius_auth_stats);
+		radius_stats_read(&stats, &radius_stats_server, RADIUS_STATS_AUTH);
+		request_stats_addvp(request, authvp, &stats);
 	}
 
 #ifdef WITH_ACCOUNTING
@@ -485,7 +678,8 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_uint32 & 0x02) != 0) &&
 	    ((flag->vp_uint32 & 0xc0) == 0)) {
-		request_stats_addvp(request, acctvp, &radius_acct_stats);
+		radius_stats_read(&stats, &radius_stats_server, RADIUS_STATS_ACCT);
+		request_stats_addvp(request, acctvp, &stats);
 	}
 #endif
 
@@ -495,7 +689,8 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_uint32 & 0x04) != 0) &&
 	    ((flag->vp_uint32 & 0x20) == 0)) {
-		request_stats_addvp(request, proxy_authvp, &proxy_auth_stats);
+		radius_stats_read(&stats, &radius_stats_proxy, RADIUS_STATS_AUTH);
+		request_stats_addvp(request, proxy_authvp, &stats);
 	}
 
 #ifdef WITH_ACCOUNTING
@@ -504,7 +699,8 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_uint32 & 0x08) != 0) &&
 	    ((flag->vp_uint32 & 0x20) == 0)) {
-		request_stats_addvp(request, proxy_acctvp, &proxy_acct_stats);
+		radius_stats_read(&stats, &radius_stats_proxy, RADIUS_STATS_ACCT);
+		request_stats_addvp(request, proxy_acctvp, &stats);
 	}
 #endif
 #endif
@@ -614,13 +810,13 @@ void request_stats_reply(REQUEST *request)
 			}
 
 			if ((flag->vp_uint32 & 0x01) != 0) {
-				request_stats_addvp(request, client_authvp,
-						    &client->auth);
+				radius_stats_read(&stats, &client->stats_id, RADIUS_STATS_AUTH);
+				request_stats_addvp(request, client_authvp, &stats);
 			}
 #ifdef WITH_ACCOUNTING
 			if ((flag->vp_uint32 & 0x02) != 0) {
-				request_stats_addvp(request, client_acctvp,
-						    &client->acct);
+				radius_stats_read(&stats, &client->stats_id, RADIUS_STATS_ACCT);
+				request_stats_addvp(request, client_acctvp, &stats);
 			}
 #endif
 		} /* else client wasn't found, don't echo it back */
@@ -666,14 +862,16 @@ void request_stats_reply(REQUEST *request)
 		if (((flag->vp_uint32 & 0x01) != 0) &&
 		    ((request->listener->type == RAD_LISTEN_AUTH) ||
 		     (request->listener->type == RAD_LISTEN_NONE))) {
-			request_stats_addvp(request, authvp, &this->stats);
+			radius_stats_read(&stats, &this->stats_id, RADIUS_STATS_AUTH);
+			request_stats_addvp(request, authvp, &stats);
 		}
 
 #ifdef WITH_ACCOUNTING
 		if (((flag->vp_uint32 & 0x02) != 0) &&
 		    ((request->listener->type == RAD_LISTEN_ACCT) ||
 		     (request->listener->type == RAD_LISTEN_NONE))) {
-			request_stats_addvp(request, acctvp, &this->stats);
+			radius_stats_read(&stats, &this->stats_id, RADIUS_STATS_ACCT);
+			request_stats_addvp(request, acctvp, &stats);
 		}
 #endif
 	}
@@ -763,15 +961,15 @@ void request_stats_reply(REQUEST *request)
 
 		if (((flag->vp_uint32 & 0x01) != 0) &&
 		    (home->type == HOME_TYPE_AUTH)) {
-			request_stats_addvp(request, proxy_authvp,
-					    &home->stats);
+			radius_stats_read(&stats, &home->stats_id, RADIUS_STATS_AUTH);
+			request_stats_addvp(request, proxy_authvp, &stats);
 		}
 
 #ifdef WITH_ACCOUNTING
 		if (((flag->vp_uint32 & 0x02) != 0) &&
 		    (home->type == HOME_TYPE_ACCT)) {
-			request_stats_addvp(request, proxy_acctvp,
-					    &home->stats);
+			radius_stats_read(&stats, &home->stats_id, RADIUS_STATS_ACCT);
+			request_stats_addvp(request, proxy_acctvp, &stats);
 		}
 #endif
 	}
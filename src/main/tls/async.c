@@ -0,0 +1,730 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file tls/async.c
+ * @brief Perform private key operations in a dedicated pool of crypto threads.
+ *
+ * Private key operations for the server's certificate are the most expensive part
+ * of a TLS handshake.  Instead of running them on the worker thread, the private
+ * key is given an RSA_METHOD / EC_KEY_METHOD which queues the operation for one of
+ * the crypto threads, and pauses the OpenSSL async job the handshake is running in.
+ *
+ * The SSL session then reports SSL_ERROR_WANT_ASYNC, and the caller waits for the
+ * async fd to become readable before continuing the handshake.
+ *
+ * If the handshake isn't running in an async job (SSL_MODE_ASYNC isn't set on the
+ * session), the operation is performed synchronously as usual.
+ *
+ * If the TLS configuration has an engine, the same key methods first pass the
+ * operation to the engine (see tls/engine.c), and only use the crypto threads,
+ * or the default software implementation, if the engine fails.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
+
+/*
+ *	RSA_METHOD and EC_KEY_METHOD are deprecated in OpenSSL 3.0,
+ *	but they're the only way of intercepting private key operations
+ *	without writing a provider.  OpenSSL 3.0 still uses the legacy
+ *	code paths for keys with a non-default method.
+ */
+#ifndef OPENSSL_SUPPRESS_DEPRECATED
+#  define OPENSSL_SUPPRESS_DEPRECATED
+#endif
+
+#ifdef WITH_TLS
+#define LOG_PREFIX "tls - "
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#ifdef SSL_MODE_ASYNC
+#include <openssl/async.h>
+#include <openssl/rsa.h>
+#include <openssl/ec.h>
+
+#include <pthread.h>
+
+typedef enum {
+	TLS_ASYNC_RSA_PRIV_ENC = 0,			//!< RSA signature.
+	TLS_ASYNC_RSA_PRIV_DEC,				//!< RSA key exchange.
+	TLS_ASYNC_ECDSA_SIGN				//!< ECDSA signature.
+} tls_async_op_type_t;
+
+/** Socket pair used to wake up a paused async job
+ *
+ * One per ASYNC_WAIT_CTX (i.e. per SSL session), created the first time an
+ * operation is offloaded.
+ */
+typedef struct {
+	int			fd[2];			//!< Crypto threads write to fd[1] when an operation
+							//!< completes, fd[0] is the async fd for the SSL session.
+	unsigned int		refs;			//!< Held by the ASYNC_WAIT_CTX and by operations in
+							//!< progress.  Protected by the pool mutex.
+} tls_async_wakeup_t;
+
+/** A private key operation queued for a crypto thread
+ *
+ * Inputs are copied, and keys are referenced, so the operation remains
+ * valid even if the SSL session is freed while it's in progress.
+ */
+typedef struct tls_async_op tls_async_op_t;
+struct tls_async_op {
+	tls_async_op_type_t	type;			//!< Which operation to perform.
+
+	tls_async_wakeup_t	*wakeup;		//!< To signal when the operation completes.
+	bool			done;			//!< Protected by the pool mutex.
+	tls_async_op_t		*next;			//!< Next operation in the queue.
+
+	uint8_t			*in;			//!< Data to sign or decrypt.
+	int			in_len;			//!< Length of data to sign or decrypt.
+
+	uint8_t			*out;			//!< Where the crypto thread writes the RSA result.
+	int			padding;		//!< RSA padding type.
+	RSA			*rsa;			//!< RSA key to use.
+
+	EC_KEY			*eckey;			//!< EC key to use.
+	ECDSA_SIG		*sig;			//!< ECDSA signature produced by the crypto thread.
+
+	int			ret;			//!< Result of the RSA operation.
+};
+
+/** The crypto threads, and the queue of operations waiting for them
+ *
+ */
+typedef struct {
+	pthread_mutex_t		mutex;			//!< Protects everything below, and the
+							//!< mutable fields of ops and wakeups.
+	pthread_cond_t		cond;			//!< Signalled when operations are queued.
+
+	tls_async_op_t		*head;			//!< Next operation to perform.
+	tls_async_op_t		**tail;			//!< Where to add the next operation.
+
+	bool			stop;			//!< Tell the crypto threads to exit.
+
+	pthread_t		*threads;		//!< The crypto threads.
+	uint32_t		num_threads;		//!< How many crypto threads were started.
+} tls_async_pool_t;
+
+static tls_async_pool_t	*async_pool;
+
+static RSA_METHOD	*async_rsa_method;
+static EC_KEY_METHOD	*async_ec_method;
+
+/*
+ *	ex_data indexes for the engine (if any) private
+ *	key operations should be passed to first.
+ */
+static int		async_rsa_engine_idx = -1;
+static int		async_ec_engine_idx = -1;
+
+/*
+ *	The default implementations, which are called by the crypto
+ *	threads, or inline if we're not running in an async job.
+ */
+static int		(*rsa_priv_enc)(int flen, unsigned char const *from, unsigned char *to, RSA *rsa, int padding);
+static int		(*rsa_priv_dec)(int flen, unsigned char const *from, unsigned char *to, RSA *rsa, int padding);
+static ECDSA_SIG	*(*ecdsa_sign_sig)(unsigned char const *dgst, int dgst_len,
+					   BIGNUM const *in_kinv, BIGNUM const *in_r, EC_KEY *eckey);
+
+/** Key for the async fd in the ASYNC_WAIT_CTX
+ *
+ * Only the address matters.
+ */
+static char const	async_wait_key = 0;
+
+/** Drop a reference to a wakeup, closing it if it was the last one
+ *
+ * @note Must be called with the pool mutex held.
+ */
+static void tls_async_wakeup_release(tls_async_wakeup_t *wakeup)
+{
+	if (--wakeup->refs > 0) return;
+
+	close(wakeup->fd[0]);
+	close(wakeup->fd[1]);
+	free(wakeup);
+}
+
+/** Called by OpenSSL when the ASYNC_WAIT_CTX is freed
+ *
+ */
+static void _tls_async_wakeup_cleanup(UNUSED ASYNC_WAIT_CTX *waitctx, UNUSED void const *key,
+				      UNUSED OSSL_ASYNC_FD fd, void *custom)
+{
+	if (!async_pool) {
+		tls_async_wakeup_release(custom);
+		return;
+	}
+
+	pthread_mutex_lock(&async_pool->mutex);
+	tls_async_wakeup_release(custom);
+	pthread_mutex_unlock(&async_pool->mutex);
+}
+
+/** Get the wakeup associated with the current async job, creating it if required
+ *
+ */
+static tls_async_wakeup_t *tls_async_wakeup_get(ASYNC_JOB *job)
+{
+	ASYNC_WAIT_CTX		*waitctx;
+	tls_async_wakeup_t	*wakeup;
+	OSSL_ASYNC_FD		fd;
+	void			*custom;
+
+	waitctx = ASYNC_get_wait_ctx(job);
+	if (!waitctx) return NULL;
+
+	if (ASYNC_WAIT_CTX_get_fd(waitctx, &async_wait_key, &fd, &custom)) return custom;
+
+	wakeup = malloc(sizeof(*wakeup));
+	if (!wakeup) return NULL;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, wakeup->fd) < 0) {
+		free(wakeup);
+		return NULL;
+	}
+	wakeup->refs = 1;
+
+	if ((fr_nonblock(wakeup->fd[0]) < 0) || (fr_nonblock(wakeup->fd[1]) < 0) ||
+	    !ASYNC_WAIT_CTX_set_wait_fd(waitctx, &async_wait_key, wakeup->fd[0], wakeup, _tls_async_wakeup_cleanup)) {
+		close(wakeup->fd[0]);
+		close(wakeup->fd[1]);
+		free(wakeup);
+		return NULL;
+	}
+
+	return wakeup;
+}
+
+/** Hand an operation to the crypto threads, and pause the job until it completes
+ *
+ * @param[in] job	we're running in.
+ * @param[in] op	to perform.
+ * @return
+ *	- 0 once the operation has completed.
+ *	- -1 if the operation couldn't be queued.  The caller should
+ *	  perform it synchronously.
+ */
+static int tls_async_submit(ASYNC_JOB *job, tls_async_op_t *op)
+{
+	tls_async_wakeup_t	*wakeup;
+	char			buff[64];
+	bool			done;
+
+	wakeup = tls_async_wakeup_get(job);
+	if (!wakeup) return -1;
+
+	pthread_mutex_lock(&async_pool->mutex);
+	wakeup->refs++;
+	op->wakeup = wakeup;
+	*async_pool->tail = op;
+	async_pool->tail = &op->next;
+	pthread_cond_signal(&async_pool->cond);
+	pthread_mutex_unlock(&async_pool->mutex);
+
+	/*
+	 *	Drain any wakeups before checking whether the
+	 *	operation is done.  A wakeup may be left over from
+	 *	a previous operation, in which case we just pause
+	 *	again.
+	 */
+	for (;;) {
+		while (read(wakeup->fd[0], buff, sizeof(buff)) > 0);
+
+		pthread_mutex_lock(&async_pool->mutex);
+		done = op->done;
+		pthread_mutex_unlock(&async_pool->mutex);
+		if (done) break;
+
+		ASYNC_pause_job();
+	}
+
+	return 0;
+}
+
+/** Allocate a new operation, with space to copy the input, and for the output
+ *
+ */
+static tls_async_op_t *tls_async_op_alloc(tls_async_op_type_t type, uint8_t const *in, int in_len, int out_len)
+{
+	tls_async_op_t *op;
+
+	op = calloc(1, sizeof(*op) + in_len + out_len);
+	if (!op) return NULL;
+
+	op->type = type;
+	op->in = (uint8_t *)(op + 1);
+	op->in_len = in_len;
+	memcpy(op->in, in, in_len);
+	op->out = op->in + in_len;
+
+	return op;
+}
+
+/** Queue an RSA private key operation, or perform it synchronously
+ *
+ */
+static int tls_async_rsa(tls_async_op_type_t type, int flen, unsigned char const *from, unsigned char *to,
+			 RSA *rsa, int padding)
+{
+	ASYNC_JOB	*job;
+	tls_async_op_t	*op;
+	tls_engine_t	*engine;
+	int		ret;
+	int		(*sync_op)(int, unsigned char const *, unsigned char *, RSA *, int);
+
+	sync_op = (type == TLS_ASYNC_RSA_PRIV_ENC) ? rsa_priv_enc : rsa_priv_dec;
+
+	/*
+	 *	Engines which support async jobs pause
+	 *	the job themselves.
+	 */
+	engine = RSA_get_ex_data(rsa, async_rsa_engine_idx);
+	if (engine) {
+		ret = tls_engine_rsa(engine, (type == TLS_ASYNC_RSA_PRIV_DEC), flen, from, to, rsa, padding);
+		if (ret > 0) return ret;
+	}
+
+	job = ASYNC_get_current_job();
+	if (!job || !async_pool) return sync_op(flen, from, to, rsa, padding);
+
+	op = tls_async_op_alloc(type, from, flen, RSA_size(rsa));
+	if (!op) return sync_op(flen, from, to, rsa, padding);
+
+	RSA_up_ref(rsa);
+	op->rsa = rsa;
+	op->padding = padding;
+
+	if (tls_async_submit(job, op) < 0) {
+		RSA_free(op->rsa);
+		free(op);
+		return sync_op(flen, from, to, rsa, padding);
+	}
+
+	ret = op->ret;
+	if (ret > 0) memcpy(to, op->out, ret);
+
+	RSA_free(op->rsa);
+	free(op);
+
+	return ret;
+}
+
+static int tls_async_rsa_priv_enc(int flen, unsigned char const *from, unsigned char *to, RSA *rsa, int padding)
+{
+	return tls_async_rsa(TLS_ASYNC_RSA_PRIV_ENC, flen, from, to, rsa, padding);
+}
+
+static int tls_async_rsa_priv_dec(int flen, unsigned char const *from, unsigned char *to, RSA *rsa, int padding)
+{
+	return tls_async_rsa(TLS_ASYNC_RSA_PRIV_DEC, flen, from, to, rsa, padding);
+}
+
+/** Queue an ECDSA signature, or perform it synchronously
+ *
+ * The ECDHE key exchange uses an ephemeral key, so only the signature
+ * with the server's key is offloaded.
+ */
+static ECDSA_SIG *tls_async_ecdsa_sign_sig(unsigned char const *dgst, int dgst_len,
+					   BIGNUM const *in_kinv, BIGNUM const *in_r, EC_KEY *eckey)
+{
+	ASYNC_JOB	*job;
+	tls_async_op_t	*op;
+	tls_engine_t	*engine;
+	ECDSA_SIG	*sig;
+
+	engine = EC_KEY_get_ex_data(eckey, async_ec_engine_idx);
+	if (engine) {
+		sig = tls_engine_ecdsa_sign_sig(engine, dgst, dgst_len, in_kinv, in_r, eckey);
+		if (sig) return sig;
+	}
+
+	job = ASYNC_get_current_job();
+	if (!job || !async_pool || in_kinv || in_r) return ecdsa_sign_sig(dgst, dgst_len, in_kinv, in_r, eckey);
+
+	op = tls_async_op_alloc(TLS_ASYNC_ECDSA_SIGN, dgst, dgst_len, 0);
+	if (!op) return ecdsa_sign_sig(dgst, dgst_len, in_kinv, in_r, eckey);
+
+	EC_KEY_up_ref(eckey);
+	op->eckey = eckey;
+
+	if (tls_async_submit(job, op) < 0) {
+		EC_KEY_free(op->eckey);
+		free(op);
+		return ecdsa_sign_sig(dgst, dgst_len, in_kinv, in_r, eckey);
+	}
+
+	sig = op->sig;
+
+	EC_KEY_free(op->eckey);
+	free(op);
+
+	return sig;
+}
+
+/** Main loop for a crypto thread
+ *
+ */
+static void *tls_async_thread(void *arg)
+{
+	tls_async_pool_t	*pool = arg;
+	tls_async_op_t		*op;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->stop && !pool->head) pthread_cond_wait(&pool->cond, &pool->mutex);
+		if (pool->stop) break;
+
+		op = pool->head;
+		pool->head = op->next;
+		if (!pool->head) pool->tail = &pool->head;
+		pthread_mutex_unlock(&pool->mutex);
+
+		switch (op->type) {
+		case TLS_ASYNC_RSA_PRIV_ENC:
+			op->ret = rsa_priv_enc(op->in_len, op->in, op->out, op->rsa, op->padding);
+			break;
+
+		case TLS_ASYNC_RSA_PRIV_DEC:
+			op->ret = rsa_priv_dec(op->in_len, op->in, op->out, op->rsa, op->padding);
+			break;
+
+		case TLS_ASYNC_ECDSA_SIGN:
+			op->sig = ecdsa_sign_sig(op->in, op->in_len, NULL, NULL, op->eckey);
+			break;
+		}
+
+		/*
+		 *	The op may be freed by the worker as soon as
+		 *	we unlock, so don't touch it after that.
+		 */
+		pthread_mutex_lock(&pool->mutex);
+		op->done = true;
+		if (write(op->wakeup->fd[1], "", 1) < 0) {
+			/* Buffer is full, so there's already a wakeup pending */
+		}
+		tls_async_wakeup_release(op->wakeup);
+		op->wakeup = NULL;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/** Stop the crypto threads
+ *
+ */
+static int _tls_async_pool_free(tls_async_pool_t *pool)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_threads; i++) pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+
+	return 0;
+}
+
+/** Create the key methods which offload private key operations
+ *
+ * Done once, the first time the crypto threads are started, or
+ * a private key is given to an engine.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int tls_async_methods_init(void)
+{
+	RSA_METHOD const	*rsa_default = RSA_PKCS1_OpenSSL();
+	EC_KEY_METHOD const	*ec_default = EC_KEY_OpenSSL();
+	int			(*ec_sign)(int type, unsigned char const *dgst, int dlen, unsigned char *sig,
+					   unsigned int *siglen, BIGNUM const *kinv, BIGNUM const *r, EC_KEY *eckey);
+	int			(*ec_sign_setup)(EC_KEY *eckey, BN_CTX *ctx_in, BIGNUM **kinvp, BIGNUM **rp);
+
+	if (async_rsa_method) return 0;
+
+	rsa_priv_enc = RSA_meth_get_priv_enc(rsa_default);
+	rsa_priv_dec = RSA_meth_get_priv_dec(rsa_default);
+
+	async_rsa_method = RSA_meth_dup(rsa_default);
+	if (!async_rsa_method ||
+	    !RSA_meth_set1_name(async_rsa_method, "FreeRADIUS async RSA method") ||
+	    !RSA_meth_set_priv_enc(async_rsa_method, tls_async_rsa_priv_enc) ||
+	    !RSA_meth_set_priv_dec(async_rsa_method, tls_async_rsa_priv_dec)) {
+		tls_strerror_printf(true, "Failed creating async RSA method");
+	error:
+		if (async_rsa_method) {
+			RSA_meth_free(async_rsa_method);
+			async_rsa_method = NULL;
+		}
+		return -1;
+	}
+
+	EC_KEY_METHOD_get_sign(ec_default, &ec_sign, &ec_sign_setup, &ecdsa_sign_sig);
+
+	async_ec_method = EC_KEY_METHOD_new(ec_default);
+	if (!async_ec_method) {
+		tls_strerror_printf(true, "Failed creating async EC method");
+		goto error;
+	}
+	EC_KEY_METHOD_set_sign(async_ec_method, ec_sign, ec_sign_setup, tls_async_ecdsa_sign_sig);
+
+	if (async_rsa_engine_idx < 0) async_rsa_engine_idx = RSA_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	if (async_ec_engine_idx < 0) async_ec_engine_idx = EC_KEY_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	if ((async_rsa_engine_idx < 0) || (async_ec_engine_idx < 0)) {
+		tls_strerror_printf(true, "Failed allocating key ex_data index");
+		EC_KEY_METHOD_free(async_ec_method);
+		async_ec_method = NULL;
+		goto error;
+	}
+
+	return 0;
+}
+
+/** Start the crypto threads
+ *
+ * Must be called after forking, and before any TLS contexts are created.
+ *
+ * @param[in] num_threads	to start.  If 0, private key operations are
+ *				performed by the workers.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int tls_async_init(uint32_t num_threads)
+{
+	tls_async_pool_t	*pool;
+	uint32_t		i;
+
+	if (!num_threads || async_pool) return 0;
+
+	if (tls_async_methods_init() < 0) {
+	error:
+		PERROR("Failed starting crypto threads");
+		tls_async_free();
+		return -1;
+	}
+
+	pool = talloc_zero(NULL, tls_async_pool_t);
+	if (!pool) {
+		fr_strerror_printf("Out of memory");
+		goto error;
+	}
+	pool->threads = talloc_array(pool, pthread_t, num_threads);
+	if (!pool->threads) {
+		talloc_free(pool);
+		fr_strerror_printf("Out of memory");
+		goto error;
+	}
+	pool->tail = &pool->head;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	talloc_set_destructor(pool, _tls_async_pool_free);
+	async_pool = pool;
+
+	for (i = 0; i < num_threads; i++) {
+		int ret;
+
+		ret = pthread_create(&pool->threads[i], NULL, tls_async_thread, pool);
+		if (ret != 0) {
+			fr_strerror_printf("Failed creating crypto thread: %s", fr_syserror(ret));
+			goto error;
+		}
+		pool->num_threads++;
+	}
+
+	INFO("Started %u crypto thread(s) for TLS private key operations", num_threads);
+
+	return 0;
+}
+
+/** Stop the crypto threads, and free the key methods
+ *
+ * Must be called after all TLS contexts have been freed.
+ */
+void tls_async_free(void)
+{
+	TALLOC_FREE(async_pool);
+
+	if (async_rsa_method) {
+		RSA_meth_free(async_rsa_method);
+		async_rsa_method = NULL;
+	}
+
+	if (async_ec_method) {
+		EC_KEY_METHOD_free(async_ec_method);
+		async_ec_method = NULL;
+	}
+}
+
+/** Whether a private key has been given one of the async key methods
+ *
+ */
+static bool tls_async_pkey_offloaded(EVP_PKEY *pkey)
+{
+	if (!async_rsa_method) return false;
+
+	switch (EVP_PKEY_base_id(pkey)) {
+	case EVP_PKEY_RSA:
+		return RSA_get_method(EVP_PKEY_get0_RSA(pkey)) == async_rsa_method;
+
+	case EVP_PKEY_EC:
+		return EC_KEY_get_method(EVP_PKEY_get0_EC_KEY(pkey)) == async_ec_method;
+
+	default:
+		return false;
+	}
+}
+
+/** Replace the private key of a context with one which uses the engine or the crypto threads
+ *
+ * Only RSA and EC keys are supported, other key types are left alone, and
+ * are always used synchronously, in software.
+ *
+ * @param[in] ctx	to update.
+ * @param[in] engine	to perform private key operations with.  May be NULL.
+ * @return
+ *	- 0 on success, or if there's nothing to offload to.
+ *	- -1 on failure.
+ */
+int tls_async_ctx_init(SSL_CTX *ctx, tls_engine_t *engine)
+{
+	EVP_PKEY	*pkey, *async_pkey;
+
+	if (!async_pool && !engine) return 0;
+
+	pkey = SSL_CTX_get0_privatekey(ctx);
+	if (!pkey) return 0;
+
+	if (tls_async_methods_init() < 0) {
+		PERROR("Failed offloading private key");
+		return -1;
+	}
+
+	async_pkey = EVP_PKEY_new();
+	if (!async_pkey) {
+		ERROR("Out of memory");
+		return -1;
+	}
+
+	switch (EVP_PKEY_base_id(pkey)) {
+	case EVP_PKEY_RSA:
+	{
+		RSA *rsa;
+
+		if (engine && !tls_engine_has_rsa(engine)) engine = NULL;
+		if (!engine && !async_pool) goto skip;
+
+		rsa = RSAPrivateKey_dup(EVP_PKEY_get0_RSA(pkey));
+		if (!rsa || !RSA_set_method(rsa, async_rsa_method) ||
+		    !RSA_set_ex_data(rsa, async_rsa_engine_idx, engine) || !EVP_PKEY_assign_RSA(async_pkey, rsa)) {
+			RSA_free(rsa);
+		error:
+			tls_log_error(NULL, "Failed creating async private key");
+			EVP_PKEY_free(async_pkey);
+			return -1;
+		}
+	}
+		break;
+
+	case EVP_PKEY_EC:
+	{
+		EC_KEY *eckey;
+
+		if (engine && !tls_engine_has_ecdsa(engine)) engine = NULL;
+		if (!engine && !async_pool) goto skip;
+
+		eckey = EC_KEY_dup(EVP_PKEY_get0_EC_KEY(pkey));
+		if (!eckey || !EC_KEY_set_method(eckey, async_ec_method) ||
+		    !EC_KEY_set_ex_data(eckey, async_ec_engine_idx, engine) || !EVP_PKEY_assign_EC_KEY(async_pkey, eckey)) {
+			EC_KEY_free(eckey);
+			goto error;
+		}
+	}
+		break;
+
+	default:
+	skip:
+		DEBUG2("Private key type %s can't be offloaded", OBJ_nid2sn(EVP_PKEY_base_id(pkey)));
+		EVP_PKEY_free(async_pkey);
+		return 0;
+	}
+
+	if (!SSL_CTX_use_PrivateKey(ctx, async_pkey)) goto error;
+	EVP_PKEY_free(async_pkey);	/* The ctx holds a reference */
+
+	return 0;
+}
+
+/** Allow a session to pause the handshake while the engine or crypto threads sign or decrypt
+ *
+ * Must only be called if the user of the session can handle #tls_session_handshake
+ * returning 2.
+ *
+ * @param[in] session	to enable async jobs for.
+ * @return
+ *	- true if async jobs were enabled.
+ *	- false if the session's private key isn't offloaded.
+ */
+bool tls_async_session_enable(tls_session_t *session)
+{
+	EVP_PKEY *pkey;
+
+	pkey = SSL_get_privatekey(session->ssl);
+	if (!pkey || !tls_async_pkey_offloaded(pkey)) return false;
+
+	SSL_set_mode(session->ssl, SSL_MODE_ASYNC);
+
+	return true;
+}
+#else
+int tls_async_init(uint32_t num_threads)
+{
+	if (num_threads) WARN("OpenSSL doesn't support async jobs, private key operations will be done by the workers");
+
+	return 0;
+}
+
+void tls_async_free(void)
+{
+}
+
+int tls_async_ctx_init(UNUSED SSL_CTX *ctx, tls_engine_t *engine)
+{
+	if (engine) WARN("OpenSSL doesn't support async jobs, private key operations won't use the engine");
+
+	return 0;
+}
+
+bool tls_async_session_enable(UNUSED tls_session_t *session)
+{
+	return false;
+}
+#endif	/* SSL_MODE_ASYNC */
+#endif	/* WITH_TLS */
@@ -20,6 +20,10 @@
  * @file tls/cache.c
  * @brief Functions to support TLS session resumption
  *
+ * Sessions are either kept in an in-memory cache shared by all the
+ * SSL_CTXs of a configuration, or passed to a virtual server which
+ * stores them wherever it likes.
+ *
  * @copyright 2015-2016 The FreeRADIUS server project
  */
 RCSID("$Id$")
@@ -33,6 +37,251 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
 
+/** A session in the in-memory cache
+ *
+ */
+typedef struct tls_cache_entry {
+	uint8_t			*id;		//!< Session ID.
+	uint8_t			*blob;		//!< Serialised session.
+	VALUE_PAIR		*vps;		//!< session-state attributes to restore on resumption.
+	time_t			expires;	//!< When the session can no longer be resumed.
+
+	struct tls_cache_entry	*prev;		//!< Previous entry in the expiry list.
+	struct tls_cache_entry	*next;		//!< Next entry in the expiry list.
+} tls_cache_entry_t;
+
+/** In-memory session cache
+ *
+ * Entries all have the same lifetime, so the list is ordered by
+ * expiry time, and the oldest entry is evicted when the cache is full.
+ */
+struct tls_cache {
+	rbtree_t		*tree;		//!< Entries by session ID.
+	tls_cache_entry_t	*head;		//!< Oldest entry.
+	tls_cache_entry_t	*tail;		//!< Newest entry.
+
+	uint32_t		max_entries;	//!< Maximum number of entries.
+	uint32_t		lifetime;	//!< How long entries can be resumed for.
+
+	pthread_mutex_t		mutex;		//!< Protects the tree and list.
+};
+
+static int tls_cache_entry_cmp(void const *one, void const *two)
+{
+	tls_cache_entry_t const *a = one, *b = two;
+	size_t a_len = talloc_array_length(a->id);
+	size_t b_len = talloc_array_length(b->id);
+	int ret;
+
+	ret = (a_len > b_len) - (a_len < b_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->id, b->id, a_len);
+}
+
+/** Remove an entry from the tree and the expiry list
+ *
+ * @note Called with the mutex held.
+ */
+static void tls_cache_entry_unlink(tls_cache_t *cache, tls_cache_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+
+	rbtree_deletebydata(cache->tree, entry);
+}
+
+/** Free all the entries in the cache
+ *
+ */
+static int _tls_cache_free(tls_cache_t *cache)
+{
+	while (cache->head) {
+		tls_cache_entry_t *entry = cache->head;
+
+		tls_cache_entry_unlink(cache, entry);
+		talloc_free(entry);
+	}
+	talloc_free(cache->tree);
+
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate an in-memory session cache
+ *
+ * @param[in] ctx to allocate the cache in.
+ * @param[in] max_entries The maximum number of sessions to cache.
+ * @param[in] lifetime How long sessions can be resumed for.
+ * @return
+ *	- A new cache.
+ *	- NULL on error.
+ */
+tls_cache_t *tls_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t lifetime)
+{
+	tls_cache_t *cache;
+
+	cache = talloc_zero(ctx, tls_cache_t);
+	if (!cache) return NULL;
+
+	cache->max_entries = max_entries;
+	cache->lifetime = lifetime;
+
+	cache->tree = rbtree_create(NULL, tls_cache_entry_cmp, NULL, 0);
+	if (!cache->tree) {
+		talloc_free(cache);
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+		talloc_free(cache->tree);
+		talloc_free(cache);
+		return NULL;
+	}
+	talloc_set_destructor(cache, _tls_cache_free);
+
+	return cache;
+}
+
+/** Add a session to the in-memory cache
+ *
+ * Replaces any existing entry with the same ID.  Expired entries are
+ * removed, and if the cache is still full the oldest entry is evicted.
+ */
+static int tls_cache_mem_write(tls_cache_t *cache, REQUEST *request, tls_session_t *tls_session)
+{
+	tls_cache_entry_t	*entry, *old, *this, *free_head = NULL;
+	time_t			now = time(NULL);
+
+	entry = talloc_zero(NULL, tls_cache_entry_t);
+	if (!entry) return -1;
+
+	entry->id = talloc_memdup(entry, tls_session->session_id, talloc_array_length(tls_session->session_id));
+	entry->blob = talloc_memdup(entry, tls_session->session_blob, talloc_array_length(tls_session->session_blob));
+	if (request->state) entry->vps = fr_pair_list_copy(entry, request->state);
+	if (!entry->id || !entry->blob || (request->state && !entry->vps)) {
+		talloc_free(entry);
+		return -1;
+	}
+	entry->expires = now + cache->lifetime;
+
+	pthread_mutex_lock(&cache->mutex);
+	old = rbtree_finddata(cache->tree, entry);
+	if (old) {
+		tls_cache_entry_unlink(cache, old);
+		old->next = free_head;
+		free_head = old;
+	}
+
+	while (cache->head &&
+	       ((cache->head->expires < now) || (rbtree_num_elements(cache->tree) >= cache->max_entries))) {
+		this = cache->head;
+
+		tls_cache_entry_unlink(cache, this);
+		this->next = free_head;
+		free_head = this;
+	}
+
+	if (!rbtree_insert(cache->tree, entry)) {
+		pthread_mutex_unlock(&cache->mutex);
+		talloc_free(entry);
+		entry = NULL;
+		goto done;
+	}
+
+	entry->prev = cache->tail;
+	if (cache->tail) {
+		cache->tail->next = entry;
+	} else {
+		cache->head = entry;
+	}
+	cache->tail = entry;
+	pthread_mutex_unlock(&cache->mutex);
+
+done:
+	/*
+	 *	Free outside of the mutex for less contention.
+	 */
+	while (free_head) {
+		this = free_head;
+		free_head = this->next;
+		talloc_free(this);
+	}
+
+	return entry ? 0 : -1;
+}
+
+/** Find a session in the in-memory cache
+ *
+ * Copies the session-state attributes stored with the session into
+ * the request, as a virtual server would.
+ *
+ * @return
+ *	- The serialised session, allocated in ctx.
+ *	- NULL if no session was found.
+ */
+static uint8_t *tls_cache_mem_read(TALLOC_CTX *ctx, tls_cache_t *cache, REQUEST *request,
+				   uint8_t const *key, size_t key_len)
+{
+	tls_cache_entry_t	*entry, my_entry;
+	uint8_t			*blob = NULL;
+	VALUE_PAIR		*vps = NULL;
+
+	/*
+	 *	Keys are compared using the length of the talloc array,
+	 *	so we need a real one.
+	 */
+	my_entry.id = talloc_memdup(ctx, key, key_len);
+	if (!my_entry.id) return NULL;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = rbtree_finddata(cache->tree, &my_entry);
+	if (entry && (entry->expires >= time(NULL))) {
+		blob = talloc_memdup(ctx, entry->blob, talloc_array_length(entry->blob));
+		if (blob && entry->vps) {
+			vps = fr_pair_list_copy(request->state_ctx, entry->vps);
+			if (!vps) TALLOC_FREE(blob);
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	talloc_free(my_entry.id);
+
+	if (vps) fr_pair_add(&request->state, vps);
+
+	return blob;
+}
+
+/** Remove a session from the in-memory cache
+ *
+ */
+static void tls_cache_mem_delete(tls_cache_t *cache, uint8_t const *key, size_t key_len)
+{
+	tls_cache_entry_t *entry, my_entry;
+
+	my_entry.id = talloc_memdup(NULL, key, key_len);
+	if (!my_entry.id) return;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = rbtree_finddata(cache->tree, &my_entry);
+	if (entry) tls_cache_entry_unlink(cache, entry);
+	pthread_mutex_unlock(&cache->mutex);
+
+	talloc_free(my_entry.id);
+	talloc_free(entry);
+}
+
 /** Add attributes identifying the TLS session to be acted upon, and the action to be performed
  *
  * Adds the following attributes to the request:
@@ -235,7 +484,7 @@ static int tls_cache_serialize(SSL *ssl, SSL_SESSION *sess)
 	return 0;
 }
 
-/** Call the specified virtual server to write session data to the cache
+/** Write session data to the in-memory cache, or call the specified virtual server to write it
  *
  * @note Should be called after all authentication methods have completed.
  *
@@ -266,6 +515,18 @@ int tls_cache_write(REQUEST *request, tls_session_t *tls_session)
 		return 1;
 	}
 
+	if (!conf->session_cache_server) {
+		if (!conf->session_cache) return 1;
+
+		if (tls_cache_mem_write(conf->session_cache, request, tls_session) < 0) {
+			RWDEBUG("Failed storing session data");
+			return -1;
+		}
+		RDEBUG2("Stored session data in the in-memory cache");
+
+		return 0;
+	}
+
 	if (tls_cache_attrs(request, tls_session->session_id, talloc_array_length(tls_session->session_id),
 			    CACHE_ACTION_SESSION_WRITE) < 0) {
 		RWDEBUG("Failed adding session key to the request");
@@ -346,17 +607,41 @@ static SSL_SESSION *tls_cache_read(SSL *ssl,
 
 	*copy = 0;
 
-	/*
-	 *	Call the virtual server to read the session
-	 */
-	switch (tls_cache_process(request, conf->session_cache_server, CACHE_ACTION_SESSION_READ)) {
-	case RLM_MODULE_OK:
-	case RLM_MODULE_UPDATED:
-		break;
+	if (!conf->session_cache_server) {
+		uint8_t *blob;
+
+		/*
+		 *	Add the session data to the request, as the
+		 *	virtual server would.
+		 */
+		blob = tls_cache_mem_read(request, conf->session_cache, request, key, key_len);
+		if (!blob) {
+			RWDEBUG("No cached session found");
+			return NULL;
+		}
 
-	default:
-		RWDEBUG("Failed acquiring session data");
-		return NULL;
+		vp = fr_pair_afrom_num(request->state_ctx, 0, FR_TLS_SESSION_DATA);
+		if (!vp) {
+			REDEBUG("%s", fr_strerror());
+			talloc_free(blob);
+			return NULL;
+		}
+		fr_pair_value_memcpy(vp, blob, talloc_array_length(blob));
+		fr_pair_add(&request->state, vp);
+		talloc_free(blob);
+	} else {
+		/*
+		 *	Call the virtual server to read the session
+		 */
+		switch (tls_cache_process(request, conf->session_cache_server, CACHE_ACTION_SESSION_READ)) {
+		case RLM_MODULE_OK:
+		case RLM_MODULE_UPDATED:
+			break;
+
+		default:
+			RWDEBUG("Failed acquiring session data");
+			return NULL;
+		}
 	}
 
 	vp = fr_pair_find_by_num(request->state, 0, FR_TLS_SESSION_DATA, TAG_ANY);
@@ -441,6 +726,11 @@ static void tls_cache_delete(SSL_CTX *ctx, SSL_SESSION *sess)
 		return;
 	}
 
+	if (!conf->session_cache_server) {
+		if (conf->session_cache) tls_cache_mem_delete(conf->session_cache, key, (size_t)key_len);
+		return;
+	}
+
 	if (tls_cache_attrs(request, key, (size_t)key_len, CACHE_ACTION_SESSION_DELETE) < 0) {
 		RWDEBUG("Failed adding session key to the request");
 		goto error;
@@ -45,6 +45,11 @@ static CONF_PARSER cache_config[] = {
 			 .dflt = "%{EAP-Type}%{Virtual-Server}", .quote = T_DOUBLE_QUOTED_STRING },
 	{ FR_CONF_OFFSET("lifetime", FR_TYPE_UINT32, fr_tls_conf_t, session_cache_lifetime), .dflt = "86400" },
 	{ FR_CONF_OFFSET("verify", FR_TYPE_BOOL, fr_tls_conf_t, session_cache_verify), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, fr_tls_conf_t, session_cache_max_entries), .dflt = "4096" },
+
+	{ FR_CONF_OFFSET("tickets", FR_TYPE_BOOL, fr_tls_conf_t, session_tickets), .dflt = "no" },
+	{ FR_CONF_OFFSET("ticket_key_lifetime", FR_TYPE_UINT32, fr_tls_conf_t, session_ticket_key_lifetime), .dflt = "3600" },
+	{ FR_CONF_OFFSET("ticket_key_file", FR_TYPE_FILE_INPUT, fr_tls_conf_t, session_ticket_key_file) },
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
 	{ FR_CONF_OFFSET("require_extended_master_secret", FR_TYPE_BOOL, fr_tls_conf_t, session_cache_require_extms), .dflt = "yes" },
@@ -52,19 +57,41 @@ static CONF_PARSER cache_config[] = {
 #endif
 
 	{ FR_CONF_DEPRECATED("enable", FR_TYPE_BOOL, fr_tls_conf_t, NULL) },
-	{ FR_CONF_DEPRECATED("max_entries", FR_TYPE_UINT32, fr_tls_conf_t, NULL) },
 	{ FR_CONF_DEPRECATED("persist_dir", FR_TYPE_STRING, fr_tls_conf_t, NULL) },
 
 	CONF_PARSER_TERMINATOR
 };
 
+static CONF_PARSER verify_cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, fr_tls_conf_t, verify_cache_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("lifetime", FR_TYPE_UINT32, fr_tls_conf_t, verify_cache_lifetime), .dflt = "3600" },
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER verify_config[] = {
 	{ FR_CONF_OFFSET("tmpdir", FR_TYPE_STRING, fr_tls_conf_t, verify_tmp_dir) },
 	{ FR_CONF_OFFSET("client", FR_TYPE_STRING, fr_tls_conf_t, verify_client_cert_cmd) },
+	{ FR_CONF_POINTER("cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) verify_cache_config },
+	CONF_PARSER_TERMINATOR
+};
+
+static CONF_PARSER engine_config[] = {
+	{ FR_CONF_OFFSET("id", FR_TYPE_STRING, fr_tls_conf_t, engine_id) },
+	{ FR_CONF_OFFSET("algorithms", FR_TYPE_STRING, fr_tls_conf_t, engine_algorithms) },
+	{ FR_CONF_OFFSET("provider", FR_TYPE_STRING, fr_tls_conf_t, provider) },
 	CONF_PARSER_TERMINATOR
 };
 
 #ifdef HAVE_OPENSSL_OCSP_H
+static CONF_PARSER ocsp_cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, cache_max_entries), .dflt = "1024" },
+	{ FR_CONF_OFFSET("lifetime", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, cache_lifetime), .dflt = "0" },
+	{ FR_CONF_OFFSET("refresh", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, cache_refresh), .dflt = "300" },
+	{ FR_CONF_OFFSET("stale", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, cache_stale), .dflt = "0" },
+
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER ocsp_config[] = {
 	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, fr_tls_ocsp_conf_t, enable), .dflt = "no" },
 
@@ -76,6 +103,8 @@ static CONF_PARSER ocsp_config[] = {
 	{ FR_CONF_OFFSET("timeout", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, timeout), .dflt = "yes" },
 	{ FR_CONF_OFFSET("softfail", FR_TYPE_BOOL, fr_tls_ocsp_conf_t, softfail), .dflt = "no" },
 
+	{ FR_CONF_POINTER("cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) ocsp_cache_config },
+
 	CONF_PARSER_TERMINATOR
 };
 #endif
@@ -134,6 +163,8 @@ CONF_PARSER tls_server_config[] = {
 
 	{ FR_CONF_POINTER("verify", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) verify_config },
 
+	{ FR_CONF_POINTER("engine", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) engine_config },
+
 #ifdef HAVE_OPENSSL_OCSP_H
 	{ FR_CONF_OFFSET("ocsp", FR_TYPE_SUBSECTION, fr_tls_conf_t, ocsp), .subcs = (void const *) ocsp_config },
 
@@ -175,9 +206,27 @@ CONF_PARSER tls_client_config[] = {
 #ifdef SSL_OP_NO_TLSv1_2
 	{ FR_CONF_OFFSET("disable_tlsv1_2", FR_TYPE_BOOL, fr_tls_conf_t, disable_tlsv1_2) },
 #endif
+
+	{ FR_CONF_POINTER("engine", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) engine_config },
 	CONF_PARSER_TERMINATOR
 };
 
+/** Load the engine and provider (if any) the contexts should use
+ *
+ * Must be called before the contexts are allocated.
+ */
+static int conf_engine_load(fr_tls_conf_t *conf)
+{
+	if (conf->provider && (tls_engine_provider_load(conf->provider) < 0)) return -1;
+
+	if (!conf->engine_id) return 0;
+
+	conf->engine = tls_engine_load(conf->engine_id, conf->engine_algorithms);
+	if (!conf->engine) return -1;
+
+	return 0;
+}
+
 #ifdef __APPLE__
 /** Use cert_admin to retrieve the password for the private key
  *
@@ -274,7 +323,16 @@ static int _conf_server_free(fr_tls_conf_t *conf)
 
 	for (i = 0; i < conf->ctx_count; i++) SSL_CTX_free(conf->ctx[i]);
 
+	TALLOC_FREE(conf->verify_cache);
+
 #ifdef HAVE_OPENSSL_OCSP_H
+	/*
+	 *	Stop the refresh threads before the
+	 *	configuration they use is freed.
+	 */
+	TALLOC_FREE(conf->ocsp.cache);
+	TALLOC_FREE(conf->staple.cache);
+
 	if (conf->ocsp.store) X509_STORE_free(conf->ocsp.store);
 	conf->ocsp.store = NULL;
 	if (conf->staple.store) X509_STORE_free(conf->staple.store);
@@ -344,6 +402,40 @@ fr_tls_conf_t *tls_conf_parse_server(CONF_SECTION *cs)
 		rad_assert(conf->ctx_count > 0);
 	}
 
+	/*
+	 *	Sessions are cached in memory unless a virtual server
+	 *	has been provided to store them.  The cache and the
+	 *	ticket keys are shared by all the contexts, as
+	 *	any of them may be used to resume a session.
+	 */
+	if (!conf->session_cache_server && (conf->session_cache_max_entries > 0)) {
+		conf->session_cache = tls_cache_alloc(conf, conf->session_cache_max_entries,
+						      conf->session_cache_lifetime);
+		if (!conf->session_cache) {
+			ERROR("Failed allocating session cache");
+			goto error;
+		}
+	}
+
+	if (conf->session_tickets) {
+		if (conf->session_ticket_key_lifetime < 60) conf->session_ticket_key_lifetime = 60;
+
+		conf->session_ticket_keys = tls_ticket_keys_alloc(conf, conf->session_ticket_key_lifetime,
+								  conf->session_ticket_key_file);
+		if (!conf->session_ticket_keys) goto error;
+	}
+
+	if (conf_engine_load(conf) < 0) goto error;
+
+	if (conf->verify_cache_max_entries > 0) {
+		conf->verify_cache = tls_validate_cache_alloc(conf, conf->verify_cache_max_entries,
+							      conf->verify_cache_lifetime);
+		if (!conf->verify_cache) {
+			ERROR("Failed allocating certificate verification cache");
+			goto error;
+		}
+	}
+
 	/*
 	 *	Initialize TLS
 	 */
@@ -373,6 +465,21 @@ fr_tls_conf_t *tls_conf_parse_server(CONF_SECTION *cs)
 		conf->staple.store = conf_ocsp_revocation_store(conf);
 		if (conf->staple.store == NULL) goto error;
 	}
+
+	/*
+	 *	Initialize the OCSP response caches.  Staples
+	 *	are refreshed before they expire, so there's
+	 *	always one available.
+	 */
+	if (conf->ocsp.enable && conf->ocsp.cache_max_entries) {
+		conf->ocsp.cache = tls_ocsp_cache_alloc(conf, &conf->ocsp, false);
+		if (!conf->ocsp.cache) goto error;
+	}
+
+	if (conf->staple.enable && conf->staple.cache_max_entries) {
+		conf->staple.cache = tls_ocsp_cache_alloc(conf, &conf->staple, true);
+		if (!conf->staple.cache) goto error;
+	}
 #endif /*HAVE_OPENSSL_OCSP_H*/
 
 	if (conf->verify_tmp_dir) {
@@ -466,6 +573,8 @@ fr_tls_conf_t *tls_conf_parse_client(CONF_SECTION *cs)
 	if (conf_cert_admin_password(conf) < 0) goto error;
 #endif
 
+	if (conf_engine_load(conf) < 0) goto error;
+
 	conf->ctx = talloc_array(conf, SSL_CTX *, conf->ctx_count);
 	for (i = 0; i < conf->ctx_count; i++) {
 		conf->ctx[i] = tls_ctx_alloc(conf, true);
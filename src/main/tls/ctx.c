@@ -272,6 +272,13 @@ SSL_CTX *tls_ctx_alloc(fr_tls_conf_t const *conf, bool client)
 		return NULL;
 	}
 
+	/*
+	 *	Have the engine perform private key operations,
+	 *	and the crypto threads perform them for server
+	 *	sessions which allow it.
+	 */
+	if ((!client || conf->engine) && (tls_async_ctx_init(ctx, conf->engine) < 0)) return NULL;
+
 	/* Load the CAs we trust */
 load_ca:
 	if (conf->ca_file || conf->ca_path) {
@@ -319,7 +326,11 @@ post_ca:
 	}
 
 #ifdef SSL_OP_NO_TICKET
-	ctx_options |= SSL_OP_NO_TICKET;
+	/*
+	 *	Session tickets are only issued if they've
+	 *	been explicitly enabled.
+	 */
+	if (client || !conf->session_tickets) ctx_options |= SSL_OP_NO_TICKET;
 #endif
 
 	if (!conf->disable_single_dh_use) {
@@ -396,6 +407,15 @@ post_ca:
 		SSL_CTX_set_mode(ctx, SSL_MODE_NO_AUTO_CHAIN);
 	}
 
+#ifdef SSL_MODE_RELEASE_BUFFERS
+	/*
+	 *	Free the read and write buffers of idle sessions.
+	 *	EAP sessions spend most of their time waiting
+	 *	for the peer, and the buffers are ~34K each.
+	 */
+	SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+#endif
+
 	/* Set Info callback */
 	SSL_CTX_set_info_callback(ctx, tls_session_info_cb);
 
@@ -422,6 +442,16 @@ post_ca:
 	verify_mode |= SSL_VERIFY_CLIENT_ONCE;
 	SSL_CTX_set_verify(ctx, verify_mode, tls_validate_cert_cb);
 
+	/*
+	 *	Skip verifying chains which were verified recently.
+	 *	Loading the CAs and CRLs into this context means
+	 *	any previous results may no longer be valid.
+	 */
+	if (!client && conf->verify_cache) {
+		SSL_CTX_set_cert_verify_callback(ctx, tls_validate_chain_cb, app_data_index);
+		tls_validate_cache_invalidate(conf->verify_cache);
+	}
+
 	if (conf->verify_depth) {
 		SSL_CTX_set_verify_depth(ctx, conf->verify_depth);
 	}
@@ -465,7 +495,14 @@ post_ca:
 	/*
 	 *	Setup session caching
 	 */
-	tls_cache_init(ctx, conf->session_cache_server ? true : false, conf->session_cache_lifetime);
+	tls_cache_init(ctx, (conf->session_cache_server || conf->session_cache) ? true : false,
+		       conf->session_cache_lifetime);
+
+	/*
+	 *	Setup session tickets
+	 */
+	if (!client && conf->session_ticket_keys &&
+	    (tls_ticket_init(ctx, conf->session_ticket_keys) < 0)) return NULL;
 
 	/*
 	 *	Load dh params
@@ -0,0 +1,312 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file tls/engine.c
+ * @brief Load hardware crypto engines and providers.
+ *
+ * Private key operations for the server's certificate are sent to the engine
+ * by the key methods in tls/async.c.  If the engine fails an operation, it's
+ * performed in software instead, and the fallback counter is incremented.
+ *
+ * Engines which support OpenSSL async jobs (such as the Intel QAT engine)
+ * pause the handshake whilst the hardware works, in exactly the same way as the
+ * crypto threads do.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
+
+/*
+ *	The ENGINE API is deprecated in OpenSSL 3.0, but it's
+ *	still the interface used by most hardware accelerators.
+ */
+#ifndef OPENSSL_SUPPRESS_DEPRECATED
+#  define OPENSSL_SUPPRESS_DEPRECATED
+#endif
+
+#ifdef WITH_TLS
+#define LOG_PREFIX "tls - "
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#ifdef HAVE_OPENSSL_ENGINE_H
+#  include <openssl/engine.h>
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/provider.h>
+#endif
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+/** An engine shared by all the TLS configurations which use it
+ *
+ */
+struct tls_engine {
+	char const		*id;			//!< Engine identifier.
+	ENGINE			*e;			//!< Functional reference to the engine.
+
+	int			(*rsa_priv_enc)(int flen, unsigned char const *from, unsigned char *to,
+						RSA *rsa, int padding);
+	int			(*rsa_priv_dec)(int flen, unsigned char const *from, unsigned char *to,
+						RSA *rsa, int padding);
+	ECDSA_SIG		*(*ecdsa_sign_sig)(unsigned char const *dgst, int dgst_len,
+						   BIGNUM const *in_kinv, BIGNUM const *in_r, EC_KEY *eckey);
+
+	atomic_uint_fast64_t	success;		//!< Operations performed by the engine.
+	atomic_uint_fast64_t	fallback;		//!< Operations the engine failed, which were
+							//!< performed in software.
+
+	tls_engine_t		*next;			//!< Next engine we loaded.
+};
+
+static tls_engine_t *engines;
+
+/** Load an engine, or return the one previously loaded with the same id
+ *
+ * @param[in] id		of the engine, e.g. "qatengine".  The engine is loaded
+ *				dynamically if it isn't built into OpenSSL.
+ * @param[in] algorithms	to make the engine the default for, in the format
+ *				accepted by ENGINE_set_default_string().  May be NULL.
+ * @return
+ *	- The engine on success.
+ *	- NULL on error.
+ */
+tls_engine_t *tls_engine_load(char const *id, char const *algorithms)
+{
+#ifdef HAVE_OPENSSL_ENGINE_H
+	tls_engine_t		*engine;
+	ENGINE			*e;
+	RSA_METHOD const	*rsa;
+	EC_KEY_METHOD const	*ec;
+
+	for (engine = engines; engine; engine = engine->next) {
+		if (strcmp(engine->id, id) == 0) goto set_default;
+	}
+
+	e = ENGINE_by_id(id);
+	if (!e) {
+		tls_log_error(NULL, "Failed loading engine \"%s\"", id);
+		return NULL;
+	}
+
+	if (!ENGINE_init(e)) {
+		tls_log_error(NULL, "Failed initialising engine \"%s\"", id);
+		ENGINE_free(e);
+		return NULL;
+	}
+	ENGINE_free(e);		/* ENGINE_init() took a functional reference */
+
+	engine = talloc_zero(NULL, tls_engine_t);
+	if (!engine) {
+		ENGINE_finish(e);
+		ERROR("Out of memory");
+		return NULL;
+	}
+	engine->id = talloc_typed_strdup(engine, id);
+	engine->e = e;
+	atomic_init(&engine->success, 0);
+	atomic_init(&engine->fallback, 0);
+
+	rsa = ENGINE_get_RSA(e);
+	if (rsa) {
+		engine->rsa_priv_enc = RSA_meth_get_priv_enc(rsa);
+		engine->rsa_priv_dec = RSA_meth_get_priv_dec(rsa);
+	}
+
+	ec = ENGINE_get_EC(e);
+	if (ec) EC_KEY_METHOD_get_sign(ec, NULL, NULL, &engine->ecdsa_sign_sig);
+
+	engine->next = engines;
+	engines = engine;
+
+	INFO("Loaded engine \"%s\" (%s), private key operations: %s%s%s", id, ENGINE_get_name(e),
+	     engine->rsa_priv_enc ? "RSA " : "", engine->ecdsa_sign_sig ? "ECDSA " : "",
+	     (engine->rsa_priv_enc || engine->ecdsa_sign_sig) ? "" : "none");
+
+set_default:
+	if (algorithms && !ENGINE_set_default_string(engine->e, algorithms)) {
+		tls_log_error(NULL, "Failed setting engine \"%s\" as the default for \"%s\"", id, algorithms);
+		return NULL;
+	}
+
+	return engine;
+#else
+	ERROR("Failed loading engine \"%s\": OpenSSL was built without engine support", id);
+	return NULL;
+#endif
+}
+
+/** Prefer the algorithms of a provider, falling back to the default provider
+ *
+ * @param[in] name	of the provider, e.g. "qatprovider".
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int tls_engine_provider_load(char const *name)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	char	*query;
+	int	ret;
+
+	if (!OSSL_PROVIDER_load(NULL, name)) {
+		tls_log_error(NULL, "Failed loading provider \"%s\"", name);
+		return -1;
+	}
+
+	/*
+	 *	Loading a provider explicitly stops the default
+	 *	one being loaded automatically.
+	 */
+	if (!OSSL_PROVIDER_load(NULL, "default")) {
+		tls_log_error(NULL, "Failed loading default provider");
+		return -1;
+	}
+
+	query = talloc_typed_asprintf(NULL, "?provider=%s", name);
+	ret = EVP_set_default_properties(NULL, query);
+	talloc_free(query);
+	if (!ret) {
+		tls_log_error(NULL, "Failed preferring provider \"%s\"", name);
+		return -1;
+	}
+
+	INFO("Loaded provider \"%s\"", name);
+
+	return 0;
+#else
+	ERROR("Failed loading provider \"%s\": Providers require OpenSSL 3.0 or later", name);
+	return -1;
+#endif
+}
+
+/** Whether the engine can perform RSA private key operations
+ *
+ */
+bool tls_engine_has_rsa(tls_engine_t const *engine)
+{
+	return engine->rsa_priv_enc && engine->rsa_priv_dec;
+}
+
+/** Whether the engine can perform ECDSA signatures
+ *
+ */
+bool tls_engine_has_ecdsa(tls_engine_t const *engine)
+{
+	return engine->ecdsa_sign_sig != NULL;
+}
+
+/** Perform an RSA private key operation with the engine
+ *
+ * @return
+ *	- >0 on success.
+ *	- <= 0 if the engine failed, and the operation should be performed in software.
+ */
+int tls_engine_rsa(tls_engine_t *engine, bool decrypt,
+		   int flen, unsigned char const *from, unsigned char *to, RSA *rsa, int padding)
+{
+	int ret;
+
+	ret = decrypt ? engine->rsa_priv_dec(flen, from, to, rsa, padding) :
+			engine->rsa_priv_enc(flen, from, to, rsa, padding);
+	if (ret > 0) {
+		atomic_fetch_add_explicit(&engine->success, 1, memory_order_relaxed);
+		return ret;
+	}
+
+	atomic_fetch_add_explicit(&engine->fallback, 1, memory_order_relaxed);
+	ERR_clear_error();
+
+	return ret;
+}
+
+/** Perform an ECDSA signature with the engine
+ *
+ * @return
+ *	- The signature on success.
+ *	- NULL if the engine failed, and the operation should be performed in software.
+ */
+ECDSA_SIG *tls_engine_ecdsa_sign_sig(tls_engine_t *engine, unsigned char const *dgst, int dgst_len,
+				     BIGNUM const *in_kinv, BIGNUM const *in_r, EC_KEY *eckey)
+{
+	ECDSA_SIG *sig;
+
+	sig = engine->ecdsa_sign_sig(dgst, dgst_len, in_kinv, in_r, eckey);
+	if (sig) {
+		atomic_fetch_add_explicit(&engine->success, 1, memory_order_relaxed);
+		return sig;
+	}
+
+	atomic_fetch_add_explicit(&engine->fallback, 1, memory_order_relaxed);
+	ERR_clear_error();
+
+	return NULL;
+}
+
+/** Return the counters of all the engines
+ *
+ * @param[in] ctx	to allocate the array in.
+ * @param[out] out	An array of counters, one per engine.
+ * @return the number of engines.
+ */
+size_t tls_engine_stats(TALLOC_CTX *ctx, tls_engine_stats_t **out)
+{
+	tls_engine_t	*engine;
+	size_t		i = 0;
+
+	for (engine = engines; engine; engine = engine->next) i++;
+
+	*out = talloc_zero_array(ctx, tls_engine_stats_t, i);
+	if (!*out) return 0;
+
+	for (engine = engines, i = 0; engine; engine = engine->next, i++) {
+		(*out)[i].id = engine->id;
+		(*out)[i].success = atomic_load_explicit(&engine->success, memory_order_relaxed);
+		(*out)[i].fallback = atomic_load_explicit(&engine->fallback, memory_order_relaxed);
+	}
+
+	return i;
+}
+
+/** Release all the engines
+ *
+ * Must be called after all TLS contexts have been freed.
+ */
+void tls_engine_free(void)
+{
+	tls_engine_t *engine, *next;
+
+	for (engine = engines; engine; engine = next) {
+		next = engine->next;
+
+#ifdef HAVE_OPENSSL_ENGINE_H
+		ENGINE_set_default(engine->e, 0);
+		ENGINE_finish(engine->e);
+#endif
+		talloc_free(engine);
+	}
+	engines = NULL;
+}
+#endif	/* WITH_TLS */
@@ -240,12 +240,42 @@ int tls_ocsp_staple_cb(SSL *ssl, void *data)
 	return ret;
 }
 
-/** Sends a OCSP request to a defined OCSP responder
+/** Add the time until the response should be refreshed to the request
  *
  */
-int tls_ocsp_check(REQUEST *request, SSL *ssl,
-		   X509_STORE *store, X509 *issuer_cert, X509 *client_cert,
-		   fr_tls_ocsp_conf_t *conf, bool staple_response)
+static void ocsp_next_update_pair(REQUEST *request, time_t next, time_t now)
+{
+	VALUE_PAIR *vp;
+
+	if (now >= next) {
+		RDEBUG2("Update time is in the past.  Not adding &TLS-OCSP-Next-Update");
+		return;
+	}
+
+	RDEBUG2("Adding OCSP TTL attribute");
+	RINDENT();
+	vp = pair_make_request("TLS-OCSP-Next-Update", NULL, T_OP_SET);
+	vp->vp_uint32 = next - now;
+	rdebug_pair(L_DBG_LVL_2, request, vp, NULL);
+	REXDENT();
+}
+
+/** Sends a OCSP request to a defined OCSP responder, and checks the certificate's status
+ *
+ * @param[in] request		The current request.
+ * @param[out] resp_out		The response from the responder.  Must be freed by the caller.
+ * @param[out] expires		When the response should be considered stale.  0 if the
+ *				certificate's status wasn't found in a valid response, and so
+ *				the response shouldn't be cached.
+ * @param[in] ssl_log		To drain OpenSSL errors into.
+ * @param[in] store		to verify the response with.
+ * @param[in] issuer_cert	Issuer of client_cert.
+ * @param[in] client_cert	to check.
+ * @param[in] conf		OCSP configuration.
+ * @return The status of the certificate.
+ */
+static ocsp_status_t ocsp_fetch(REQUEST *request, OCSP_RESPONSE **resp_out, time_t *expires, BIO *ssl_log,
+				X509_STORE *store, X509 *issuer_cert, X509 *client_cert, fr_tls_ocsp_conf_t *conf)
 {
 	OCSP_CERTID	*certid;
 	OCSP_REQUEST	*req = NULL;
@@ -257,7 +287,7 @@ int tls_ocsp_check(REQUEST *request, SSL *ssl,
 	char		host_header[1024];
 	int		use_ssl = -1;
 	long		this_fudge = OCSP_MAX_VALIDITY_PERIOD, this_max_age = -1;
-	BIO		*conn = NULL, *ssl_log = NULL;
+	BIO		*conn = NULL;
 	ocsp_status_t   ocsp_status = OCSP_STATUS_FAILED;
 	ocsp_status_t	status;
 	ASN1_GENERALIZEDTIME *rev, *this_update, *next_update;
@@ -269,77 +299,8 @@ int tls_ocsp_check(REQUEST *request, SSL *ssl,
 #endif
 	struct timeval	now = { 0, 0 };
 	time_t		next;
-	VALUE_PAIR	*vp;
-
-	if (conf->cache_server) switch (tls_cache_process(request, conf->cache_server,
-							       CACHE_ACTION_OCSP_READ)) {
-	case RLM_MODULE_REJECT:
-		REDEBUG("Told to force OCSP validation failure from cached response");
-		return OCSP_STATUS_FAILED;
-
-	case RLM_MODULE_OK:
-	case RLM_MODULE_UPDATED:
-	/*
-	 *	These are fine for OCSP too, we don't *expect* to always
-	 *	have a cached OCSP status.
-	 */
-	case RLM_MODULE_NOTFOUND:
-	case RLM_MODULE_NOOP:
-		break;
 
-	default:
-		RWDEBUG("Failed retrieving cached OCSP status");
-		break;
-	}
-
-	/*
-	 *	Allow us to cache the OCSP verified state externally
-	 */
-	vp = fr_pair_find_by_num(request->control, 0, FR_TLS_OCSP_CERT_VALID, TAG_ANY);
-	if (vp) switch (vp->vp_uint32) {
-	case 0:	/* no */
-		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = no, forcing OCSP failure");
-		return OCSP_STATUS_FAILED;
-
-	case 1: /* yes */
-		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = yes, forcing OCSP success");
-
-		/*
-		 *	If this fails, and an OCSP stapled response is required,
-		 *	we need to run the full OCSP check.
-		 */
-		if (staple_response) {
-			vp = fr_pair_find_by_num(request->control, 0, FR_TLS_OCSP_RESPONSE, TAG_ANY);
-			if (!vp) {
-				RDEBUG2("No &control:TLS-OCSP-Response attribute found, performing full OCSP check");
-				break;
-			}
-			if (ocsp_staple_from_pair(request, ssl, vp) < 0) {
-				RWDEBUG("Failed setting OCSP staple response in SSL session");
-				return OCSP_STATUS_FAILED;
-			}
-		}
-
-		return OCSP_STATUS_OK;
-
-	case 2: /* skipped */
-		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = skipped, skipping OCSP check");
-		return conf->softfail ? OCSP_STATUS_OK : OCSP_STATUS_FAILED;
-
-	case 3: /* unknown */
-	default:
-		break;
-	}
-
-	/*
-	 *	Setup logging for this OCSP operation
-	 */
-	ssl_log = BIO_new(BIO_s_mem());
-	if (!ssl_log) {
-		REDEBUG("Failed creating log queue");
-		ocsp_status = OCSP_STATUS_SKIPPED;
-		goto finish;
-	}
+	*expires = 0;
 
 	/*
 	 *	Create OCSP Request
@@ -363,7 +324,8 @@ int tls_ocsp_check(REQUEST *request, SSL *ssl,
 		OCSP_parse_url(url, &host, &port, &path, &use_ssl);
 		if (!host || !port || !path) {
 			RWDEBUG("Host or port or path missing from configured URL \"%s\".  Not doing OCSP", url);
-			goto skipped;
+			ocsp_status = OCSP_STATUS_SKIPPED;
+			goto finish;
 		}
 	} else {
 		int ret;
@@ -380,7 +342,8 @@ int tls_ocsp_check(REQUEST *request, SSL *ssl,
 				goto use_url;
 			}
 			RWDEBUG("No OCSP URL in certificate.  Not doing OCSP");
-			goto skipped;
+			ocsp_status = OCSP_STATUS_SKIPPED;
+			goto finish;
 
 		case 1:
 			rad_assert(host && port && path);
@@ -393,7 +356,8 @@ int tls_ocsp_check(REQUEST *request, SSL *ssl,
 	/* Check host and port length are sane, then create Host: HTTP header */
 	if ((strlen(host) + strlen(port) + 2) > sizeof(host_header)) {
 		RWDEBUG("Host and port too long");
-		goto skipped;
+		ocsp_status = OCSP_STATUS_SKIPPED;
+		goto finish;
 	}
 	snprintf(host_header, sizeof(host_header), "%s:%s", host, port);
 
@@ -530,33 +494,27 @@ int tls_ocsp_check(REQUEST *request, SSL *ssl,
 		}
 	}
 
+	/*
+	 *	Sometimes we already know what 'now' is depending
+	 *	on the code path, other times we don't.
+	 */
+	if (now.tv_sec == 0) gettimeofday(&now, NULL);
+
 	/*
 	 *	When an OCSP validation command is used with OpenSSL
 	 *	next_update is NULL.
 	 */
 	if (next_update) {
-		/*
-		 *	Sometimes we already know what 'now' is depending
-		 *	on the code path, other times we don't.
-		 */
-		if (now.tv_sec == 0) gettimeofday(&now, NULL);
 		if (tls_utils_asn1time_to_epoch(&next, next_update) < 0) {
 			RPEDEBUG("Failed parsing next_update time");
 			ocsp_status = OCSP_STATUS_SKIPPED;
 			goto finish;
 		}
-		if (now.tv_sec < next){
-			RDEBUG2("Adding OCSP TTL attribute");
-			RINDENT();
-			vp = pair_make_request("TLS-OCSP-Next-Update", NULL, T_OP_SET);
-			vp->vp_uint32 = next - now.tv_sec;
-			rdebug_pair(L_DBG_LVL_2, request, vp, NULL);
-			REXDENT();
-		} else {
-			RDEBUG2("Update time is in the past.  Not adding &TLS-OCSP-Next-Update");
-		}
+		ocsp_next_update_pair(request, next, now.tv_sec);
+		if (next > now.tv_sec) *expires = next;
 	} else {
 		RDEBUG2("Update time not provided.  Not adding &TLS-OCSP-Next-Update");
+		if (conf->cache_lifetime) *expires = now.tv_sec + conf->cache_lifetime;
 	}
 
 	switch (status) {
@@ -584,6 +542,621 @@ int tls_ocsp_check(REQUEST *request, SSL *ssl,
 		break;
 	}
 
+finish:
+	/* Free OCSP Stuff */
+	OCSP_REQUEST_free(req);
+	OCSP_BASICRESP_free(bresp);
+	OPENSSL_free(host);
+	OPENSSL_free(port);
+	OPENSSL_free(path);
+	BIO_free_all(conn);
+
+	*resp_out = resp;
+
+	return ocsp_status;
+}
+
+/** A response in the in-memory OCSP cache
+ *
+ */
+typedef struct ocsp_cache_entry {
+	uint8_t			*key;		//!< DER encoded OCSP_CERTID, identifying the
+						//!< issuer and the certificate's serial.
+	uint8_t			*resp;		//!< DER encoded response.
+	ocsp_status_t		status;		//!< Status of the certificate in the response.
+	time_t			expires;	//!< nextUpdate, or when the response was fetched
+						//!< plus cache_lifetime.
+	time_t			refresh;	//!< When to fetch a new response.
+
+	X509			*cert;		//!< Certificate to fetch new responses for.
+	X509			*issuer_cert;	//!< Issuer of cert.
+	X509_STORE		*store;		//!< To verify new responses with.
+
+	struct ocsp_cache_entry	*prev;		//!< Previous entry, oldest first.
+	struct ocsp_cache_entry	*next;		//!< Next entry, oldest first.
+} ocsp_cache_entry_t;
+
+/** A response to fetch in the background
+ *
+ */
+typedef struct ocsp_cache_job {
+	X509			*cert;		//!< Certificate to fetch a response for.
+	X509			*issuer_cert;	//!< Issuer of cert.
+	X509_STORE		*store;		//!< To verify the response with.
+
+	struct ocsp_cache_job	*next;		//!< Next job in the queue.
+} ocsp_cache_job_t;
+
+/** In-memory OCSP response cache
+ *
+ * Responses which are used within "refresh" seconds of expiring are
+ * fetched again by a background thread, so requests aren't blocked
+ * waiting for the responder while the response is still valid.
+ */
+struct tls_ocsp_cache {
+	fr_tls_ocsp_conf_t	*conf;		//!< OCSP configuration the cache belongs to.
+	bool			prefetch;	//!< Refresh entries whether or not they're used.
+
+	rbtree_t		*tree;		//!< Entries by key.
+	ocsp_cache_entry_t	*head;		//!< Oldest entry.
+	ocsp_cache_entry_t	*tail;		//!< Newest entry.
+
+	ocsp_cache_job_t	*jobs;		//!< Responses to fetch.
+
+	pthread_t		thread;		//!< Fetches responses in the background.
+	bool			running;	//!< Whether the thread has been started.
+	bool			stop;		//!< Tell the thread to exit.
+
+	pthread_mutex_t		mutex;		//!< Protects all of the above.
+	pthread_cond_t		cond;		//!< Signalled when jobs are added, or the thread should exit.
+};
+
+/** How long to wait before retrying a failed refresh
+ *
+ */
+#define OCSP_CACHE_RETRY (10)
+
+static int ocsp_cache_entry_cmp(void const *one, void const *two)
+{
+	ocsp_cache_entry_t const *a = one, *b = two;
+	size_t a_len = talloc_array_length(a->key);
+	size_t b_len = talloc_array_length(b->key);
+	int ret;
+
+	ret = (a_len > b_len) - (a_len < b_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->key, b->key, a_len);
+}
+
+static int _ocsp_cache_entry_free(ocsp_cache_entry_t *entry)
+{
+	X509_free(entry->cert);
+	X509_free(entry->issuer_cert);
+	X509_STORE_free(entry->store);
+
+	return 0;
+}
+
+static int _ocsp_cache_job_free(ocsp_cache_job_t *job)
+{
+	X509_free(job->cert);
+	X509_free(job->issuer_cert);
+	X509_STORE_free(job->store);
+
+	return 0;
+}
+
+/** Create the key used to find responses for a certificate
+ *
+ */
+static uint8_t *ocsp_cache_key(TALLOC_CTX *ctx, X509 *issuer_cert, X509 *cert)
+{
+	OCSP_CERTID	*certid;
+	uint8_t		*key, *p;
+	int		len;
+
+	certid = OCSP_cert_to_id(NULL, cert, issuer_cert);
+	if (!certid) return NULL;
+
+	len = i2d_OCSP_CERTID(certid, NULL);
+	if (len <= 0) {
+		OCSP_CERTID_free(certid);
+		return NULL;
+	}
+
+	p = key = talloc_array(ctx, uint8_t, len);
+	if (key) i2d_OCSP_CERTID(certid, &p);
+	OCSP_CERTID_free(certid);
+
+	return key;
+}
+
+/** Remove an entry from the tree and the list
+ *
+ * @note Called with the mutex held.
+ */
+static void ocsp_cache_entry_unlink(tls_ocsp_cache_t *cache, ocsp_cache_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+
+	rbtree_deletebydata(cache->tree, entry);
+}
+
+static void *ocsp_cache_thread(void *arg);
+
+/** Queue a new response to be fetched for an entry
+ *
+ * @note Called with the mutex held.
+ */
+static void ocsp_cache_queue(tls_ocsp_cache_t *cache, ocsp_cache_entry_t *entry, time_t now)
+{
+	ocsp_cache_job_t *job;
+
+	/*
+	 *	If the refresh fails, try again later.
+	 */
+	entry->refresh = now + OCSP_CACHE_RETRY;
+
+	if (!cache->running) {
+		if (pthread_create(&cache->thread, NULL, ocsp_cache_thread, cache) != 0) {
+			ERROR("Failed creating OCSP refresh thread: %s", fr_syserror(errno));
+			return;
+		}
+		cache->running = true;
+	}
+
+	job = talloc_zero(NULL, ocsp_cache_job_t);
+	if (!job) return;
+
+	X509_up_ref(entry->cert);
+	job->cert = entry->cert;
+	X509_up_ref(entry->issuer_cert);
+	job->issuer_cert = entry->issuer_cert;
+	X509_STORE_up_ref(entry->store);
+	job->store = entry->store;
+	talloc_set_destructor(job, _ocsp_cache_job_free);
+
+	job->next = cache->jobs;
+	cache->jobs = job;
+
+	pthread_cond_signal(&cache->cond);
+}
+
+/** Add a response to the cache, replacing any existing response for the certificate
+ *
+ */
+static void ocsp_cache_insert(tls_ocsp_cache_t *cache, OCSP_RESPONSE *resp, ocsp_status_t status, time_t expires,
+			      X509_STORE *store, X509 *issuer_cert, X509 *cert)
+{
+	ocsp_cache_entry_t	*entry, *old, *this, *free_head = NULL;
+	time_t			now = time(NULL);
+	uint8_t			*p;
+	int			len;
+
+	len = i2d_OCSP_RESPONSE(resp, NULL);
+	if (len <= 0) return;
+
+	entry = talloc_zero(NULL, ocsp_cache_entry_t);
+	if (!entry) return;
+
+	entry->key = ocsp_cache_key(entry, issuer_cert, cert);
+	p = entry->resp = talloc_array(entry, uint8_t, len);
+	if (!entry->key || !entry->resp) {
+		talloc_free(entry);
+		return;
+	}
+	i2d_OCSP_RESPONSE(resp, &p);
+
+	entry->status = status;
+	entry->expires = expires;
+	/*
+	 *	If the response is valid for less than the refresh
+	 *	period, refresh it half way through its lifetime.
+	 */
+	if (!cache->conf->cache_refresh) {
+		entry->refresh = (time_t)-1;
+	} else if ((expires - (time_t)cache->conf->cache_refresh) > now) {
+		entry->refresh = expires - cache->conf->cache_refresh;
+	} else {
+		entry->refresh = now + ((expires - now) / 2);
+	}
+
+	X509_up_ref(cert);
+	entry->cert = cert;
+	X509_up_ref(issuer_cert);
+	entry->issuer_cert = issuer_cert;
+	X509_STORE_up_ref(store);
+	entry->store = store;
+	talloc_set_destructor(entry, _ocsp_cache_entry_free);
+
+	pthread_mutex_lock(&cache->mutex);
+	old = rbtree_finddata(cache->tree, entry);
+	if (old) {
+		ocsp_cache_entry_unlink(cache, old);
+		old->next = free_head;
+		free_head = old;
+	}
+
+	/*
+	 *	Remove entries which can no longer be used, then
+	 *	the oldest entries if the cache is still full.
+	 */
+	while (cache->head &&
+	       (((cache->head->expires + (time_t)cache->conf->cache_stale) < now) ||
+		(rbtree_num_elements(cache->tree) >= cache->conf->cache_max_entries))) {
+		this = cache->head;
+
+		ocsp_cache_entry_unlink(cache, this);
+		this->next = free_head;
+		free_head = this;
+	}
+
+	if (!rbtree_insert(cache->tree, entry)) {
+		pthread_mutex_unlock(&cache->mutex);
+		talloc_free(entry);
+		goto done;
+	}
+
+	entry->prev = cache->tail;
+	if (cache->tail) {
+		cache->tail->next = entry;
+	} else {
+		cache->head = entry;
+	}
+	cache->tail = entry;
+	pthread_mutex_unlock(&cache->mutex);
+
+done:
+	while (free_head) {
+		this = free_head;
+		free_head = this->next;
+		talloc_free(this);
+	}
+}
+
+/** Find a cached response for a certificate
+ *
+ * If the response is due to be refreshed, a new one is fetched in
+ * the background.
+ *
+ * @param[out] resp	The cached response.  Must be freed by the caller.
+ * @param[out] status	Status of the certificate in the response.
+ * @param[out] expires	When the response expires.
+ * @param[in] cache	to search.
+ * @param[in] key	identifying the certificate.
+ * @return
+ *	- 1 if a valid response was found.
+ *	- 2 if an expired response was found, which may be used if
+ *	  the responder can't be contacted.
+ *	- 0 if no response was found.
+ */
+static int ocsp_cache_find(OCSP_RESPONSE **resp, ocsp_status_t *status, time_t *expires,
+			   tls_ocsp_cache_t *cache, uint8_t *key)
+{
+	ocsp_cache_entry_t	*entry, find = { .key = key };
+	uint8_t const		*p;
+	time_t			now = time(NULL);
+	int			ret = 0;
+
+	*resp = NULL;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = rbtree_finddata(cache->tree, &find);
+	if (!entry || ((entry->expires + (time_t)cache->conf->cache_stale) < now)) goto done;
+
+	p = entry->resp;
+	*resp = d2i_OCSP_RESPONSE(NULL, &p, talloc_array_length(entry->resp));
+	if (!*resp) goto done;
+
+	*status = entry->status;
+	*expires = entry->expires;
+
+	if (entry->expires < now) {
+		ret = 2;
+		goto done;
+	}
+	ret = 1;
+
+	if ((entry->refresh != (time_t)-1) && (now >= entry->refresh)) ocsp_cache_queue(cache, entry, now);
+
+done:
+	pthread_mutex_unlock(&cache->mutex);
+
+	return ret;
+}
+
+/** Fetch a new response for a cached certificate
+ *
+ */
+static void ocsp_cache_refresh(tls_ocsp_cache_t *cache, ocsp_cache_job_t *job)
+{
+	REQUEST		*request;
+	OCSP_RESPONSE	*resp = NULL;
+	BIO		*ssl_log;
+	ocsp_status_t	status;
+	time_t		expires;
+
+	request = request_alloc(NULL);
+	if (!request) return;
+
+	request->packet = fr_radius_alloc(request, false);
+	ssl_log = BIO_new(BIO_s_mem());
+	if (!request->packet || !ssl_log) goto finish;
+
+	RDEBUG2("Refreshing cached OCSP response");
+	RINDENT();
+	status = ocsp_fetch(request, &resp, &expires, ssl_log, job->store, job->issuer_cert, job->cert, cache->conf);
+	REXDENT();
+	if (expires) {
+		ocsp_cache_insert(cache, resp, status, expires, job->store, job->issuer_cert, job->cert);
+	} else {
+		RWDEBUG("Failed refreshing cached OCSP response, retrying in %i seconds", OCSP_CACHE_RETRY);
+	}
+
+	/* Remove OpenSSL errors from queue */
+	while (ERR_get_error());
+
+finish:
+	OCSP_RESPONSE_free(resp);
+	BIO_free(ssl_log);
+	talloc_free(request);
+}
+
+/** Fetch queued responses, and for prefetch caches queue responses due to be refreshed
+ *
+ */
+static void *ocsp_cache_thread(void *arg)
+{
+	tls_ocsp_cache_t	*cache = arg;
+	ocsp_cache_job_t	*job;
+
+	pthread_mutex_lock(&cache->mutex);
+	while (!cache->stop) {
+		struct timespec	ts;
+
+		if (cache->prefetch) {
+			ocsp_cache_entry_t	*entry;
+			time_t			now = time(NULL);
+
+			for (entry = cache->head; entry; entry = entry->next) {
+				if ((entry->refresh != (time_t)-1) && (now >= entry->refresh)) {
+					ocsp_cache_queue(cache, entry, now);
+				}
+			}
+		}
+
+		job = cache->jobs;
+		if (job) {
+			cache->jobs = job->next;
+			pthread_mutex_unlock(&cache->mutex);
+
+			ocsp_cache_refresh(cache, job);
+			talloc_free(job);
+
+			pthread_mutex_lock(&cache->mutex);
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		pthread_cond_timedwait(&cache->cond, &cache->mutex, &ts);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return NULL;
+}
+
+static int _ocsp_cache_free(tls_ocsp_cache_t *cache)
+{
+	if (cache->running) {
+		pthread_mutex_lock(&cache->mutex);
+		cache->stop = true;
+		pthread_cond_signal(&cache->cond);
+		pthread_mutex_unlock(&cache->mutex);
+
+		pthread_join(cache->thread, NULL);
+	}
+
+	while (cache->jobs) {
+		ocsp_cache_job_t *job = cache->jobs;
+
+		cache->jobs = job->next;
+		talloc_free(job);
+	}
+
+	while (cache->head) {
+		ocsp_cache_entry_t *entry = cache->head;
+
+		ocsp_cache_entry_unlink(cache, entry);
+		talloc_free(entry);
+	}
+	talloc_free(cache->tree);
+
+	pthread_cond_destroy(&cache->cond);
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate an in-memory OCSP response cache
+ *
+ * @param[in] ctx	to allocate the cache in.
+ * @param[in] conf	OCSP configuration.
+ * @param[in] prefetch	Refresh responses before they expire whether or
+ *			not they're used.  Used for our own certificate, so
+ *			that a staple is always available.
+ * @return
+ *	- A new cache.
+ *	- NULL on error.
+ */
+tls_ocsp_cache_t *tls_ocsp_cache_alloc(TALLOC_CTX *ctx, fr_tls_ocsp_conf_t *conf, bool prefetch)
+{
+	tls_ocsp_cache_t	*cache;
+
+	cache = talloc_zero(ctx, tls_ocsp_cache_t);
+	if (!cache) return NULL;
+
+	cache->conf = conf;
+	cache->prefetch = prefetch;
+
+	cache->tree = rbtree_create(NULL, ocsp_cache_entry_cmp, NULL, 0);
+	if (!cache->tree) {
+		talloc_free(cache);
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+		talloc_free(cache->tree);
+		talloc_free(cache);
+		return NULL;
+	}
+
+	if (pthread_cond_init(&cache->cond, NULL) != 0) {
+		pthread_mutex_destroy(&cache->mutex);
+		talloc_free(cache->tree);
+		talloc_free(cache);
+		return NULL;
+	}
+	talloc_set_destructor(cache, _ocsp_cache_free);
+
+	return cache;
+}
+
+/** Check the status of a certificate using OCSP
+ *
+ * Uses the cached status if available, otherwise sends a request
+ * to the OCSP responder.
+ */
+int tls_ocsp_check(REQUEST *request, SSL *ssl,
+		   X509_STORE *store, X509 *issuer_cert, X509 *client_cert,
+		   fr_tls_ocsp_conf_t *conf, bool staple_response)
+{
+	OCSP_RESPONSE	*resp = NULL;
+	BIO		*ssl_log = NULL;
+	ocsp_status_t   ocsp_status = OCSP_STATUS_FAILED;
+	ocsp_status_t	cached_status = OCSP_STATUS_FAILED;
+	OCSP_RESPONSE	*cached_resp = NULL;
+	time_t		expires, cached_expires = 0;
+	uint8_t		*key = NULL;
+	int		cached = 0;
+	VALUE_PAIR	*vp;
+
+	if (conf->cache_server) switch (tls_cache_process(request, conf->cache_server,
+							       CACHE_ACTION_OCSP_READ)) {
+	case RLM_MODULE_REJECT:
+		REDEBUG("Told to force OCSP validation failure from cached response");
+		return OCSP_STATUS_FAILED;
+
+	case RLM_MODULE_OK:
+	case RLM_MODULE_UPDATED:
+	/*
+	 *	These are fine for OCSP too, we don't *expect* to always
+	 *	have a cached OCSP status.
+	 */
+	case RLM_MODULE_NOTFOUND:
+	case RLM_MODULE_NOOP:
+		break;
+
+	default:
+		RWDEBUG("Failed retrieving cached OCSP status");
+		break;
+	}
+
+	/*
+	 *	Allow us to cache the OCSP verified state externally
+	 */
+	vp = fr_pair_find_by_num(request->control, 0, FR_TLS_OCSP_CERT_VALID, TAG_ANY);
+	if (vp) switch (vp->vp_uint32) {
+	case 0:	/* no */
+		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = no, forcing OCSP failure");
+		return OCSP_STATUS_FAILED;
+
+	case 1: /* yes */
+		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = yes, forcing OCSP success");
+
+		/*
+		 *	If this fails, and an OCSP stapled response is required,
+		 *	we need to run the full OCSP check.
+		 */
+		if (staple_response) {
+			vp = fr_pair_find_by_num(request->control, 0, FR_TLS_OCSP_RESPONSE, TAG_ANY);
+			if (!vp) {
+				RDEBUG2("No &control:TLS-OCSP-Response attribute found, performing full OCSP check");
+				break;
+			}
+			if (ocsp_staple_from_pair(request, ssl, vp) < 0) {
+				RWDEBUG("Failed setting OCSP staple response in SSL session");
+				return OCSP_STATUS_FAILED;
+			}
+		}
+
+		return OCSP_STATUS_OK;
+
+	case 2: /* skipped */
+		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = skipped, skipping OCSP check");
+		return conf->softfail ? OCSP_STATUS_OK : OCSP_STATUS_FAILED;
+
+	case 3: /* unknown */
+	default:
+		break;
+	}
+
+	/*
+	 *	Setup logging for this OCSP operation
+	 */
+	ssl_log = BIO_new(BIO_s_mem());
+	if (!ssl_log) {
+		REDEBUG("Failed creating log queue");
+		ocsp_status = OCSP_STATUS_SKIPPED;
+		goto finish;
+	}
+
+	/*
+	 *	Use the response from the in-memory cache if
+	 *	it's still valid.
+	 */
+	if (conf->cache) {
+		key = ocsp_cache_key(request, issuer_cert, client_cert);
+		if (key) cached = ocsp_cache_find(&cached_resp, &cached_status, &cached_expires, conf->cache, key);
+		if (cached == 1) {
+			RDEBUG2("Using cached OCSP response");
+			ocsp_next_update_pair(request, cached_expires, time(NULL));
+			resp = cached_resp;
+			ocsp_status = cached_status;
+			goto finish;
+		}
+	}
+
+	ocsp_status = ocsp_fetch(request, &resp, &expires, ssl_log, store, issuer_cert, client_cert, conf);
+	if (conf->cache) {
+		if (expires) {
+			ocsp_cache_insert(conf->cache, resp, ocsp_status, expires, store, issuer_cert, client_cert);
+
+		/*
+		 *	If the responder couldn't be contacted, use
+		 *	the expired response instead.
+		 */
+		} else if ((ocsp_status == OCSP_STATUS_SKIPPED) && (cached == 2)) {
+			RWDEBUG("Using expired cached OCSP response");
+			SSL_DRAIN_ERROR_QUEUE(RWDEBUG, "", ssl_log);
+			OCSP_RESPONSE_free(resp);
+			resp = cached_resp;
+			ocsp_status = cached_status;
+		}
+	}
+
 finish:
 	switch (ocsp_status) {
 	case OCSP_STATUS_OK:
@@ -600,7 +1173,10 @@ finish:
 			 *	Set the stapled response for the current
 			 *	SSL session.
 			 */
-			if (ocsp_staple_from_pair(request, ssl, vp) < 0) return -1;
+			if (ocsp_staple_from_pair(request, ssl, vp) < 0) {
+				ocsp_status = -1;
+				goto done;
+			}
 			vp = NULL;	/* It's in the request, don't need to free it! */
 		}
 
@@ -650,14 +1226,10 @@ finish:
 		break;
 	}
 
-	/* Free OCSP Stuff */
-	OCSP_REQUEST_free(req);
-	OCSP_BASICRESP_free(bresp);
+done:
+	if (cached_resp != resp) OCSP_RESPONSE_free(cached_resp);
 	OCSP_RESPONSE_free(resp);
-	OPENSSL_free(host);
-	OPENSSL_free(port);
-	OPENSSL_free(path);
-	BIO_free_all(conn);
+	talloc_free(key);
 	BIO_free(ssl_log);
 
 	return ocsp_status;
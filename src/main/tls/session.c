@@ -71,9 +71,75 @@ inline static void record_init(tls_record_t *record)
  */
 inline static void record_close(tls_record_t *record)
 {
+	TALLOC_FREE(record->data);
+	record->size = 0;
 	record->used = 0;
 }
 
+/** Ensure a record buffer can hold a given amount of data
+ *
+ * Records start out empty, and only grow as large as the data written to them,
+ * so idle sessions don't hold #FR_TLS_MAX_RECORD_SIZE bytes per buffer.
+ *
+ * @param[in] record	buffer to grow.
+ * @param[in] size	the buffer must be able to hold.  Limited to #FR_TLS_MAX_RECORD_SIZE.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int tls_record_reserve(tls_record_t *record, size_t size)
+{
+	uint8_t *data;
+
+	if (size > FR_TLS_MAX_RECORD_SIZE) size = FR_TLS_MAX_RECORD_SIZE;
+	if (record->size >= size) return 0;
+
+	/*
+	 *	Round up, so a record being filled by
+	 *	EAP fragments isn't reallocated for
+	 *	every one of them.
+	 */
+	size = (size + 1023) & ~((size_t) 1023);
+	if (size > FR_TLS_MAX_RECORD_SIZE) size = FR_TLS_MAX_RECORD_SIZE;
+
+	if (!record->data) {
+		data = talloc_array(record->ctx, uint8_t, size);
+	} else {
+		data = talloc_realloc(record->ctx, record->data, uint8_t, size);
+	}
+	if (!data) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	record->data = data;
+	record->size = size;
+
+	return 0;
+}
+
+/** Shrink a record buffer to the data it holds
+ *
+ * @param[in] record	buffer to shrink.
+ */
+static void record_compact(tls_record_t *record)
+{
+	uint8_t *data;
+
+	if (record->used == 0) {
+		record_close(record);
+		return;
+	}
+
+	if (record->used == record->size) return;
+
+	data = talloc_realloc(record->ctx, record->data, uint8_t, record->used);
+	if (!data) return;	/* Keep the larger buffer */
+
+	record->data = data;
+	record->size = record->used;
+}
+
 /** Copy data to the intermediate buffer, before we send it somewhere
  *
  * @param[in] record	buffer to write to.
@@ -88,6 +154,8 @@ inline static unsigned int record_from_buff(tls_record_t *record, void const *in
 	if (added > inlen) added = inlen;
 	if (added == 0) return 0;
 
+	if (tls_record_reserve(record, record->used + added) < 0) return 0;
+
 	memcpy(record->data + record->used, in, added);
 	record->used += added;
 
@@ -1114,7 +1182,12 @@ int tls_session_recv(REQUEST *request, tls_session_t *session)
 	 *      SSL session, and put it into the decrypted
 	 *      data buffer.
 	 */
-	ret = SSL_read(session->ssl, session->clean_out.data, sizeof(session->clean_out.data));
+	if (tls_record_reserve(&session->clean_out, FR_TLS_MAX_RECORD_SIZE) < 0) {
+		RPERROR("Failed allocating buffer for application data");
+		return -1;
+	}
+
+	ret = SSL_read(session->ssl, session->clean_out.data, session->clean_out.size);
 	if (ret < 0) {
 		int code;
 
@@ -1189,8 +1262,11 @@ int tls_session_send(REQUEST *request, tls_session_t *session)
 		record_to_buff(&session->clean_in, NULL, ret);
 
 		/* Get the dirty data from Bio to send it */
-		ret = BIO_read(session->from_ssl, session->dirty_out.data,
-			       sizeof(session->dirty_out.data));
+		if (tls_record_reserve(&session->dirty_out, BIO_ctrl_pending(session->from_ssl)) < 0) {
+			RPERROR("Failed allocating buffer for TLS data");
+			return 0;
+		}
+		ret = BIO_read(session->from_ssl, session->dirty_out.data, session->dirty_out.size);
 		if (ret > 0) {
 			session->dirty_out.used = ret;
 		} else {
@@ -1220,11 +1296,17 @@ int tls_session_handshake_alert(UNUSED REQUEST *request, tls_session_t *session,
  * Advance the TLS handshake by feeding OpenSSL data from dirty_in,
  * and reading data from OpenSSL into dirty_out.
  *
+ * If #tls_async_session_enable was called for the session, a private key operation
+ * may be handed to an engine or the crypto threads.  In that case 2 is returned, and
+ * the caller must wait for one of session->async_fd to become readable, then call this
+ * function again.
+ *
  * @param request The current request.
  * @param session The current TLS session.
  * @return
  *	- 0 on error.
  *	- 1 on success.
+ *	- 2 if a private key operation is in progress.
  */
 int tls_session_handshake(REQUEST *request, tls_session_t *session)
 {
@@ -1250,14 +1332,20 @@ int tls_session_handshake(REQUEST *request, tls_session_t *session)
 	 *	Feed dirty data into OpenSSL, so that is can either
 	 *	process it as Application data (decrypting it)
 	 *	or continue the TLS handshake.
+	 *
+	 *	If we're continuing after a private key operation
+	 *	the data has already been fed to OpenSSL.
 	 */
-	ret = BIO_write(session->into_ssl, session->dirty_in.data, session->dirty_in.used);
-	if (ret != (int)session->dirty_in.used) {
-		REDEBUG("Failed writing %zd bytes to TLS BIO: %d", session->dirty_in.used, ret);
+	if (!session->async_pending) {
+		ret = BIO_write(session->into_ssl, session->dirty_in.data, session->dirty_in.used);
+		if (ret != (int)session->dirty_in.used) {
+			REDEBUG("Failed writing %zd bytes to TLS BIO: %d", session->dirty_in.used, ret);
+			record_init(&session->dirty_in);
+			return 0;
+		}
 		record_init(&session->dirty_in);
-		return 0;
 	}
-	record_init(&session->dirty_in);
+	session->async_pending = false;
 
 	/*
 	 *	Magic/More magic? Although SSL_read is normally
@@ -1279,12 +1367,42 @@ int tls_session_handshake(REQUEST *request, tls_session_t *session)
 	 *	If acting as a server SSL_set_accept_state must have
 	 *	been called before this function.
 	 */
+	if (tls_record_reserve(&session->clean_out, FR_TLS_MAX_RECORD_SIZE) < 0) {
+		RPERROR("Failed allocating buffer for application data");
+		return 0;
+	}
+
 	ret = SSL_read(session->ssl, session->clean_out.data + session->clean_out.used,
-		       sizeof(session->clean_out.data) - session->clean_out.used);
+		       session->clean_out.size - session->clean_out.used);
 	if (ret > 0) {
 		session->clean_out.used += ret;
 		return 1;
 	}
+
+#ifdef SSL_MODE_ASYNC
+	/*
+	 *	The async job performing the handshake has been
+	 *	paused, whilst an engine or a crypto thread signs
+	 *	or decrypts.
+	 */
+	if (SSL_get_error(session->ssl, ret) == SSL_ERROR_WANT_ASYNC) {
+		OSSL_ASYNC_FD	fds[TLS_ASYNC_MAX_FDS];
+		size_t		numfds = 0, i;
+
+		if (!SSL_get_all_async_fds(session->ssl, NULL, &numfds) ||
+		    (numfds == 0) || (numfds > TLS_ASYNC_MAX_FDS) ||
+		    !SSL_get_all_async_fds(session->ssl, fds, &numfds)) {
+			REDEBUG("Failed retrieving fds for private key operation");
+			return 0;
+		}
+
+		RDEBUG2("Waiting for private key operation to complete");
+		for (i = 0; i < numfds; i++) session->async_fd[i] = fds[i];
+		session->async_fd_count = numfds;
+		session->async_pending = true;
+		return 2;
+	}
+#endif
 	if (!tls_log_io_error(request, session, ret, "Failed in SSL_read")) return 0;
 
 	/*
@@ -1320,6 +1438,15 @@ int tls_session_handshake(REQUEST *request, tls_session_t *session)
 		q[0] = '\0';
 
 		RDEBUG2("Cipher suite: %s", cipher_desc_clean);
+
+#ifdef SSL_MODE_ASYNC
+		/*
+		 *	Application data is handled by tls_session_recv
+		 *	and tls_session_send, which can't wait for an
+		 *	engine, so stop running in async jobs.
+		 */
+		SSL_clear_mode(session->ssl, SSL_MODE_ASYNC);
+#endif
 #if OPENSSL_VERSION_NUMBER >= 0x10001000L
 		/*
 		 *	Cache the SSL_SESSION pointer.
@@ -1364,8 +1491,12 @@ int tls_session_handshake(REQUEST *request, tls_session_t *session)
 	 */
 	ret = BIO_ctrl_pending(session->from_ssl);
 	if (ret > 0) {
-		ret = BIO_read(session->from_ssl, session->dirty_out.data,
-			       sizeof(session->dirty_out.data));
+		if (tls_record_reserve(&session->dirty_out, ret) < 0) {
+			RPERROR("Failed allocating buffer for TLS data");
+			return 0;
+		}
+
+		ret = BIO_read(session->from_ssl, session->dirty_out.data, session->dirty_out.size);
 		if (ret > 0) {
 			session->dirty_out.used = ret;
 		} else if (BIO_should_retry(session->from_ssl)) {
@@ -1395,6 +1526,11 @@ int tls_session_handshake(REQUEST *request, tls_session_t *session)
 		 */
 		session->info.content_type = SSL3_RT_ALERT;
 
+		if (tls_record_reserve(&session->dirty_out, 7) < 0) {
+			RPERROR("Failed allocating buffer for TLS alert");
+			return 0;
+		}
+
 		session->dirty_out.data[0] = session->info.content_type;
 		session->dirty_out.data[1] = 3;
 		session->dirty_out.data[2] = 1;
@@ -1413,6 +1549,24 @@ int tls_session_handshake(REQUEST *request, tls_session_t *session)
 	return 1;
 }
 
+/** Release memory a TLS session doesn't need between rounds
+ *
+ * Empty record buffers are freed, and the others are shrunk to the data
+ * they hold.  OpenSSL releases its own read and write buffers, as the
+ * contexts are created with SSL_MODE_RELEASE_BUFFERS.
+ *
+ * Should be called when the session will be idle until the peer responds.
+ *
+ * @param[in] session	to compact.
+ */
+void tls_session_compact(tls_session_t *session)
+{
+	record_compact(&session->clean_in);
+	record_compact(&session->clean_out);
+	record_compact(&session->dirty_in);
+	record_compact(&session->dirty_out);
+}
+
 /** Free a TLS session and any associated OpenSSL data
  *
  * @param session to free.
@@ -1434,6 +1588,8 @@ static void session_init(tls_session_t *session)
 {
 	session->ssl = NULL;
 	session->into_ssl = session->from_ssl = NULL;
+	session->clean_in.ctx = session->clean_out.ctx = session;
+	session->dirty_in.ctx = session->dirty_out.ctx = session;
 	record_init(&session->clean_in);
 	record_init(&session->clean_out);
 	record_init(&session->dirty_in);
@@ -1458,16 +1614,21 @@ static void session_init(tls_session_t *session)
  */
 tls_session_t *tls_session_init_client(TALLOC_CTX *ctx, fr_tls_conf_t *conf)
 {
-	int		ret;
 	int		verify_mode;
 	tls_session_t	*session = NULL;
 	REQUEST		*request;
 
 	session = talloc_zero(ctx, tls_session_t);
 	if (!session) return NULL;
+	session_init(session);
 
 	talloc_set_destructor(session, _tls_session_free);
 
+	session->record_init = record_init;
+	session->record_close = record_close;
+	session->record_from_buff = record_from_buff;
+	session->record_to_buff = record_to_buff;
+
 	session->ctx = conf->ctx[(conf->ctx_count == 1) ? 0 : conf->ctx_next++ % conf->ctx_count];	/* mutex not needed */
 	rad_assert(session->ctx);
 
@@ -1479,9 +1640,33 @@ tls_session_t *tls_session_init_client(TALLOC_CTX *ctx, fr_tls_conf_t *conf)
 		return NULL;
 	}
 
+	/*
+	 *	The handshake code adds attributes to the request, so
+	 *	it needs a packet.
+	 */
 	request = request_alloc(session);
+	request->packet = fr_radius_alloc(request, false);
+	if (!request->packet) {
+		talloc_free(session);
+		return NULL;
+	}
 	SSL_set_ex_data(session->ssl, FR_TLS_EX_INDEX_REQUEST, (void *)request);
 
+	/*
+	 *	As with server sessions, all TLS I/O is done to and
+	 *	from memory, so that the caller can use non-blocking
+	 *	sockets.  Callers which want OpenSSL to do the I/O can
+	 *	still call SSL_set_fd().
+	 *
+	 *	The caller starts the handshake with
+	 *	SSL_do_handshake(), and continues it with
+	 *	tls_session_handshake().
+	 */
+	session->into_ssl = BIO_new(BIO_s_mem());
+	session->from_ssl = BIO_new(BIO_s_mem());
+	SSL_set_bio(session->ssl, session->into_ssl, session->from_ssl);
+	SSL_set_connect_state(session->ssl);
+
 	/*
 	 *	Add the message callback to identify what type of
 	 *	message/handshake is passed
@@ -1501,14 +1686,6 @@ tls_session_t *tls_session_init_client(TALLOC_CTX *ctx, fr_tls_conf_t *conf)
 	SSL_set_ex_data(session->ssl, FR_TLS_EX_INDEX_CONF, (void *)conf);
 	SSL_set_ex_data(session->ssl, FR_TLS_EX_INDEX_TLS_SESSION, (void *)session);
 
-	ret = SSL_connect(session->ssl);
-	if (ret <= 0) {
-		tls_log_io_error(NULL, session, ret, "Failed in SSL_connect");
-		talloc_free(session);
-
-		return NULL;
-	}
-
 	session->mtu = conf->fragment_size;
 
 	return session;
@@ -1718,7 +1895,9 @@ tls_session_t *tls_session_init_server(TALLOC_CTX *ctx, fr_tls_conf_t *conf, REQ
 		session->mtu = vp->vp_uint32;
 	}
 
-	if (conf->session_cache_server) session->allow_session_resumption = true; /* otherwise it's false */
+	if (conf->session_cache_server || conf->session_cache || conf->session_tickets) {
+		session->allow_session_resumption = true; /* otherwise it's false */
+	}
 
 	return session;
 }
@@ -0,0 +1,384 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file tls/ticket.c
+ * @brief Issue and decrypt RFC 5077 session tickets.
+ *
+ * Tickets are encrypted with AES-256-CBC and authenticated with
+ * HMAC-SHA256.  Keys are either generated and rotated by the server,
+ * or read from a file, so that every server in a cluster can decrypt
+ * the tickets issued by the others.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
+
+#ifdef WITH_TLS
+#define LOG_PREFIX "tls - "
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <sys/stat.h>
+
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+#else
+#  include <openssl/hmac.h>
+#endif
+
+/** A ticket key
+ *
+ * Uses the same layout as other servers' ticket key files, so
+ * keys can be shared with them.
+ */
+typedef struct {
+	uint8_t			name[16];	//!< Identifies the key used to encrypt a ticket.
+	uint8_t			hmac[32];	//!< HMAC-SHA256 key.
+	uint8_t			aes[32];	//!< AES-256-CBC key.
+} tls_ticket_key_t;
+
+/** The keys used to encrypt and decrypt tickets
+ *
+ * The first key is used to encrypt new tickets.  All of them
+ * are used to decrypt tickets, and tickets encrypted with any
+ * other key than the first are renewed.
+ */
+struct tls_ticket_keys {
+	tls_ticket_key_t	*keys;		//!< Array of keys, current key first.
+	uint32_t		lifetime;	//!< How long generated keys are used to encrypt tickets.
+	char const		*file;		//!< File to read keys from, instead of generating them.
+
+	time_t			rotated;	//!< When the keys were last generated or read.
+	time_t			mtime;		//!< Modification time of the key file when it was read.
+	time_t			next_check;	//!< When to next check the key file for changes.
+
+	pthread_mutex_t		mutex;		//!< Protects the keys.
+};
+
+static int _tls_ticket_keys_free(tls_ticket_keys_t *keys)
+{
+	if (keys->keys) OPENSSL_cleanse(keys->keys, talloc_array_length(keys->keys) * sizeof(keys->keys[0]));
+	pthread_mutex_destroy(&keys->mutex);
+
+	return 0;
+}
+
+/** Generate a new current key, keeping the old one to decrypt existing tickets
+ *
+ * @note Called with the mutex held.
+ */
+static int tls_ticket_keys_generate(tls_ticket_keys_t *keys, time_t now)
+{
+	tls_ticket_key_t	*new;
+
+	new = talloc_array(keys, tls_ticket_key_t, keys->keys ? 2 : 1);
+	if (!new) return -1;
+
+	if (RAND_bytes((uint8_t *)&new[0], sizeof(new[0])) != 1) {
+		talloc_free(new);
+		return -1;
+	}
+	if (keys->keys) new[1] = keys->keys[0];
+
+	if (keys->keys) {
+		OPENSSL_cleanse(keys->keys, talloc_array_length(keys->keys) * sizeof(keys->keys[0]));
+		talloc_free(keys->keys);
+	}
+	keys->keys = new;
+	keys->rotated = now;
+
+	DEBUG2("Generated new session ticket key");
+
+	return 0;
+}
+
+/** (Re-)read the keys from the key file
+ *
+ * @note Called with the mutex held.
+ */
+static int tls_ticket_keys_read(tls_ticket_keys_t *keys, time_t now)
+{
+	FILE			*fp;
+	struct stat		st;
+	tls_ticket_key_t	*new;
+	size_t			num;
+
+	fp = fopen(keys->file, "r");
+	if (!fp) {
+		ERROR("Failed opening session ticket key file \"%s\": %s", keys->file, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fileno(fp), &st) < 0) {
+		ERROR("Failed reading session ticket key file \"%s\": %s", keys->file, fr_syserror(errno));
+	error:
+		fclose(fp);
+		return -1;
+	}
+
+	if ((st.st_size == 0) || (st.st_size % sizeof(tls_ticket_key_t)) != 0) {
+		ERROR("Session ticket key file \"%s\" must contain one or more keys of %zu bytes",
+		      keys->file, sizeof(tls_ticket_key_t));
+		goto error;
+	}
+	num = st.st_size / sizeof(tls_ticket_key_t);
+
+	new = talloc_array(keys, tls_ticket_key_t, num);
+	if (!new) goto error;
+
+	if (fread(new, sizeof(new[0]), num, fp) != num) {
+		ERROR("Failed reading session ticket key file \"%s\"", keys->file);
+		talloc_free(new);
+		goto error;
+	}
+	fclose(fp);
+
+	if (keys->keys) {
+		OPENSSL_cleanse(keys->keys, talloc_array_length(keys->keys) * sizeof(keys->keys[0]));
+		talloc_free(keys->keys);
+	}
+	keys->keys = new;
+	keys->mtime = st.st_mtime;
+	keys->rotated = now;
+
+	DEBUG2("Read %zu session ticket key(s) from \"%s\"", num, keys->file);
+
+	return 0;
+}
+
+/** Rotate the keys, or re-read the key file if it has changed
+ *
+ * If new keys can't be obtained the old ones continue to be used.
+ *
+ * @note Called with the mutex held.
+ */
+static void tls_ticket_keys_refresh(tls_ticket_keys_t *keys, time_t now)
+{
+	struct stat st;
+
+	if (!keys->file) {
+		if (now >= (keys->rotated + (time_t)keys->lifetime)) (void) tls_ticket_keys_generate(keys, now);
+		return;
+	}
+
+	/*
+	 *	Don't stat the file for every ticket.
+	 */
+	if (now < keys->next_check) return;
+	keys->next_check = now + 1;
+
+	if (stat(keys->file, &st) < 0) return;
+	if (st.st_mtime == keys->mtime) return;
+
+	(void) tls_ticket_keys_read(keys, now);
+}
+
+/** Allocate the keys used to encrypt and decrypt session tickets
+ *
+ * @param[in] ctx	to allocate the keys in.
+ * @param[in] lifetime	How long a generated key is used to encrypt new tickets.
+ *			Tickets encrypted with the previous key can still be
+ *			decrypted for the same period.
+ * @param[in] file	to read keys from.  If NULL keys are generated.
+ * @return
+ *	- The ticket keys.
+ *	- NULL on error.
+ */
+tls_ticket_keys_t *tls_ticket_keys_alloc(TALLOC_CTX *ctx, uint32_t lifetime, char const *file)
+{
+	tls_ticket_keys_t	*keys;
+	time_t			now = time(NULL);
+	int			ret;
+
+	keys = talloc_zero(ctx, tls_ticket_keys_t);
+	if (!keys) return NULL;
+
+	keys->lifetime = lifetime;
+	if (file) keys->file = talloc_strdup(keys, file);
+
+	if (pthread_mutex_init(&keys->mutex, NULL) != 0) {
+		talloc_free(keys);
+		return NULL;
+	}
+	talloc_set_destructor(keys, _tls_ticket_keys_free);
+
+	if (keys->file) {
+		ret = tls_ticket_keys_read(keys, now);
+	} else {
+		ret = tls_ticket_keys_generate(keys, now);
+		if (ret < 0) ERROR("Failed generating session ticket key");
+	}
+	if (ret < 0) {
+		talloc_free(keys);
+		return NULL;
+	}
+	keys->next_check = now + 1;
+
+	return keys;
+}
+
+/** Find the key to encrypt a ticket with, or the key a ticket was encrypted with
+ *
+ * @param[out] out	Where to copy the key.
+ * @param[in] keys	to search.
+ * @param[in] name	of the key to find.  If NULL returns the current key.
+ * @return
+ *	- 1 the key was found, and is the current key.
+ *	- 2 the key was found, and tickets encrypted with it should be renewed.
+ *	- 0 the key wasn't found.
+ */
+static int tls_ticket_key_find(tls_ticket_key_t *out, tls_ticket_keys_t *keys, uint8_t const *name)
+{
+	size_t	i, num;
+	int	ret = 0;
+
+	pthread_mutex_lock(&keys->mutex);
+	tls_ticket_keys_refresh(keys, time(NULL));
+
+	if (!name) {
+		*out = keys->keys[0];
+		ret = 1;
+		goto done;
+	}
+
+	num = talloc_array_length(keys->keys);
+	for (i = 0; i < num; i++) {
+		if (memcmp(keys->keys[i].name, name, sizeof(keys->keys[i].name)) != 0) continue;
+
+		*out = keys->keys[i];
+		ret = (i == 0) ? 1 : 2;
+		break;
+	}
+
+done:
+	pthread_mutex_unlock(&keys->mutex);
+
+	return ret;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int tls_ticket_mac_init(EVP_MAC_CTX *hctx, tls_ticket_key_t *key)
+{
+	static char	digest[] = "SHA256";
+	OSSL_PARAM	params[3];
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key->hmac, sizeof(key->hmac));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0);
+	params[2] = OSSL_PARAM_construct_end();
+
+	return EVP_MAC_CTX_set_params(hctx, params);
+}
+#else
+static int tls_ticket_mac_init(HMAC_CTX *hctx, tls_ticket_key_t *key)
+{
+	return HMAC_Init_ex(hctx, key->hmac, sizeof(key->hmac), EVP_sha256(), NULL);
+}
+#endif
+
+/** Encrypt a new ticket, or find the key to decrypt an existing one
+ *
+ * @param[in] ssl	session state.
+ * @param[in] key_name	of the key the ticket was encrypted with.  Written
+ *			when encrypting a ticket.
+ * @param[in] iv	for the cipher.  Written when encrypting a ticket.
+ * @param[in] ctx	to initialise with the cipher and key.
+ * @param[in] hctx	to initialise with the HMAC key.
+ * @param[in] enc	1 if a ticket is being encrypted, 0 if it's being decrypted.
+ * @return
+ *	- 1 success.
+ *	- 2 the ticket was decrypted, and should be renewed.
+ *	- 0 the key wasn't found, perform a full handshake.
+ *	- -1 error.
+ */
+static int tls_ticket_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv, EVP_CIPHER_CTX *ctx,
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			 EVP_MAC_CTX *hctx,
+#else
+			 HMAC_CTX *hctx,
+#endif
+			 int enc)
+{
+	fr_tls_conf_t		*conf;
+	tls_ticket_key_t	key;
+	int			ret;
+
+	conf = talloc_get_type_abort(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)), fr_tls_conf_t);
+	rad_assert(conf->session_ticket_keys);
+
+	if (enc) {
+		(void) tls_ticket_key_find(&key, conf->session_ticket_keys, NULL);
+
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+			ret = -1;
+			goto done;
+		}
+		memcpy(key_name, key.name, sizeof(key.name));
+
+		if ((EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key.aes, iv) != 1) ||
+		    (tls_ticket_mac_init(hctx, &key) != 1)) {
+			ret = -1;
+			goto done;
+		}
+		ret = 1;
+		goto done;
+	}
+
+	ret = tls_ticket_key_find(&key, conf->session_ticket_keys, key_name);
+	if (ret == 0) {
+		DEBUG2("Session ticket was encrypted with an unknown key");
+		goto done;
+	}
+
+	if ((EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key.aes, iv) != 1) ||
+	    (tls_ticket_mac_init(hctx, &key) != 1)) ret = -1;
+
+done:
+	OPENSSL_cleanse(&key, sizeof(key));
+
+	return ret;
+}
+
+/** Sets callbacks on a SSL_CTX to issue and decrypt session tickets
+ *
+ * @param[in] ctx	to modify.
+ * @param[in] keys	to encrypt and decrypt tickets with.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int tls_ticket_init(SSL_CTX *ctx, tls_ticket_keys_t *keys)
+{
+	rad_assert(keys);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	if (SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tls_ticket_cb) != 1) {
+#else
+	if (SSL_CTX_set_tlsext_ticket_key_cb(ctx, tls_ticket_cb) != 1) {
+#endif
+		tls_log_error(NULL, "Failed setting session ticket callback");
+		return -1;
+	}
+
+	return 0;
+}
+#endif /* WITH_TLS */
@@ -31,6 +31,269 @@
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include <pthread.h>
+#include <openssl/sha.h>
+
+/** A client certificate chain which was verified successfully
+ *
+ */
+typedef struct tls_verify_cache_entry tls_verify_cache_entry_t;
+struct tls_verify_cache_entry {
+	uint8_t			fingerprint[SHA256_DIGEST_LENGTH];	//!< SHA256 of the client certificate.
+	uint64_t		generation;		//!< Of the CA store when the chain was verified.
+	time_t			expires;		//!< Earliest of the lifetime, the notAfter of any
+							//!< certificate in the chain, and the nextUpdate
+							//!< of any CRL used.
+
+	X509			*issuer_cert;		//!< Issuer of the client certificate.
+
+	tls_verify_cache_entry_t *prev;			//!< Previous entry, oldest first.
+	tls_verify_cache_entry_t *next;			//!< Next entry, oldest first.
+};
+
+/** Cache of successful chain verifications
+ *
+ * Verifying a chain means checking the signature of every certificate, and
+ * searching the CRLs for each of them.  Devices which roam re-authenticate
+ * with the same certificate, so we remember the chains which verified, and
+ * only run the per-certificate checks in #tls_validate_cert_cb (CN, issuer,
+ * the external command and OCSP) for them.
+ */
+struct tls_verify_cache {
+	uint32_t		max_entries;		//!< Maximum number of entries.
+	uint32_t		lifetime;		//!< Maximum time an entry can be used for.
+	uint64_t		generation;		//!< Incremented when the CA store or CRLs are loaded.
+
+	rbtree_t		*tree;			//!< Entries by fingerprint.
+	tls_verify_cache_entry_t *head;			//!< Oldest entry.
+	tls_verify_cache_entry_t *tail;			//!< Newest entry.
+
+	pthread_mutex_t		mutex;			//!< Protects all of the above.
+};
+
+static int verify_cache_entry_cmp(void const *one, void const *two)
+{
+	tls_verify_cache_entry_t const *a = one, *b = two;
+
+	return memcmp(a->fingerprint, b->fingerprint, sizeof(a->fingerprint));
+}
+
+static int _verify_cache_entry_free(tls_verify_cache_entry_t *entry)
+{
+	X509_free(entry->issuer_cert);
+
+	return 0;
+}
+
+static int _verify_cache_free(tls_verify_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Remove an entry from the tree and the list, and free it
+ *
+ * @note Called with the mutex held.
+ */
+static void verify_cache_entry_free(tls_verify_cache_t *cache, tls_verify_cache_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+
+	rbtree_deletebydata(cache->tree, entry);
+	talloc_free(entry);
+}
+
+/** Allocate a cache of successful chain verifications
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] max_entries	Maximum number of chains to remember.
+ * @param[in] lifetime		Maximum time to remember a chain for.
+ * @return
+ *	- A new cache.
+ *	- NULL on error.
+ */
+tls_verify_cache_t *tls_validate_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t lifetime)
+{
+	tls_verify_cache_t *cache;
+
+	cache = talloc_zero(ctx, tls_verify_cache_t);
+	if (!cache) return NULL;
+
+	cache->tree = rbtree_create(cache, verify_cache_entry_cmp, NULL, 0);
+	if (!cache->tree) {
+		talloc_free(cache);
+		return NULL;
+	}
+	cache->max_entries = max_entries;
+	cache->lifetime = lifetime;
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	talloc_set_destructor(cache, _verify_cache_free);
+
+	return cache;
+}
+
+/** Forget all the chains verified with the previous CA store or CRLs
+ *
+ * Must be called whenever the trusted CAs or CRLs are (re)loaded.
+ *
+ * @param[in] cache	to invalidate.
+ */
+void tls_validate_cache_invalidate(tls_verify_cache_t *cache)
+{
+	pthread_mutex_lock(&cache->mutex);
+	cache->generation++;
+	while (cache->head) verify_cache_entry_free(cache, cache->head);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Find when a verified chain should no longer be trusted without checking it again
+ *
+ * That's the earliest of the notAfter of any certificate in the chain, and
+ * the nextUpdate of the CRLs for each certificate.
+ */
+static time_t verify_cache_expires(fr_tls_conf_t const *conf, X509_STORE_CTX *x509_ctx, time_t expires)
+{
+	STACK_OF(X509)	*chain = X509_STORE_CTX_get0_chain(x509_ctx);
+	int		i;
+
+	for (i = 0; i < sk_X509_num(chain); i++) {
+		X509		*cert = sk_X509_value(chain, i);
+		time_t		when;
+
+		if ((tls_utils_asn1time_to_epoch(&when, X509_get0_notAfter(cert)) < 0) || (when < expires)) {
+			expires = when;
+		}
+
+		/*
+		 *	The root isn't checked against a CRL.
+		 */
+		if (conf->check_crl && (i < (sk_X509_num(chain) - 1))) {
+			STACK_OF(X509_CRL)	*crls;
+			int			j;
+
+			crls = X509_STORE_CTX_get1_crls(x509_ctx, X509_get_issuer_name(cert));
+			for (j = 0; j < sk_X509_CRL_num(crls); j++) {
+				ASN1_TIME const *next_update = X509_CRL_get0_nextUpdate(sk_X509_CRL_value(crls, j));
+
+				if (!next_update) continue;
+
+				if ((tls_utils_asn1time_to_epoch(&when, next_update) < 0) || (when < expires)) {
+					expires = when;
+				}
+			}
+			sk_X509_CRL_pop_free(crls, X509_CRL_free);
+		}
+	}
+
+	return expires;
+}
+
+/** Add a chain which has just been verified to the cache
+ *
+ */
+static void verify_cache_insert(fr_tls_conf_t const *conf, X509_STORE_CTX *x509_ctx,
+				uint8_t const fingerprint[SHA256_DIGEST_LENGTH], uint64_t generation)
+{
+	tls_verify_cache_t		*cache = conf->verify_cache;
+	tls_verify_cache_entry_t	*entry, find;
+	STACK_OF(X509)			*chain = X509_STORE_CTX_get0_chain(x509_ctx);
+	time_t				now = time(NULL), expires;
+
+	/*
+	 *	Need the issuer to perform the
+	 *	per-certificate checks.
+	 */
+	if (sk_X509_num(chain) < 2) return;
+
+	expires = verify_cache_expires(conf, x509_ctx, now + cache->lifetime);
+	if (expires <= now) return;
+
+	memcpy(find.fingerprint, fingerprint, sizeof(find.fingerprint));
+
+	pthread_mutex_lock(&cache->mutex);
+	if (generation != cache->generation) {
+		pthread_mutex_unlock(&cache->mutex);
+		return;
+	}
+
+	entry = rbtree_finddata(cache->tree, &find);
+	if (entry) verify_cache_entry_free(cache, entry);
+
+	while (cache->head && (rbtree_num_elements(cache->tree) >= cache->max_entries)) {
+		verify_cache_entry_free(cache, cache->head);
+	}
+
+	entry = talloc_zero(cache, tls_verify_cache_entry_t);
+	if (!entry) {
+		pthread_mutex_unlock(&cache->mutex);
+		return;
+	}
+	memcpy(entry->fingerprint, fingerprint, sizeof(entry->fingerprint));
+	entry->generation = generation;
+	entry->expires = expires;
+	entry->issuer_cert = sk_X509_value(chain, 1);
+	X509_up_ref(entry->issuer_cert);
+	talloc_set_destructor(entry, _verify_cache_entry_free);
+
+	if (!rbtree_insert(cache->tree, entry)) {
+		pthread_mutex_unlock(&cache->mutex);
+		talloc_free(entry);
+		return;
+	}
+
+	entry->prev = cache->tail;
+	if (cache->tail) {
+		cache->tail->next = entry;
+	} else {
+		cache->head = entry;
+	}
+	cache->tail = entry;
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Find the issuer of a chain which was verified recently
+ *
+ * @return
+ *	- The issuer of the client certificate.  Must be freed with X509_free().
+ *	- NULL if the chain must be verified.
+ */
+static X509 *verify_cache_find(tls_verify_cache_t *cache, uint8_t const fingerprint[SHA256_DIGEST_LENGTH],
+			       uint64_t *generation)
+{
+	tls_verify_cache_entry_t	*entry, find;
+	X509				*issuer_cert = NULL;
+
+	memcpy(find.fingerprint, fingerprint, sizeof(find.fingerprint));
+
+	pthread_mutex_lock(&cache->mutex);
+	*generation = cache->generation;
+
+	entry = rbtree_finddata(cache->tree, &find);
+	if (entry) {
+		if ((entry->generation != cache->generation) || (entry->expires <= time(NULL))) {
+			verify_cache_entry_free(cache, entry);
+		} else {
+			issuer_cert = entry->issuer_cert;
+			X509_up_ref(issuer_cert);
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return issuer_cert;
+}
+
 /** Validates a certificate using custom logic
  *
  * Before trusting a certificate, we make sure that the certificate is
@@ -337,6 +600,70 @@ int tls_validate_cert_cb(int ok, X509_STORE_CTX *x509_ctx)
 	return my_ok;
 }
 
+/** Verify a certificate chain, or use the result of a recent verification
+ *
+ * If the client's certificate was verified recently, against the same CA
+ * store, and none of the certificates or CRLs have expired, the signature
+ * and CRL checks are skipped.  The callback is then called for the issuer
+ * and the client certificate, exactly as X509_verify_cert() would do, so
+ * that the attributes are created and the per-certificate checks (including
+ * OCSP) are always performed.
+ *
+ * Set as the certificate verification callback with SSL_CTX_set_cert_verify_callback().
+ *
+ * @param[in] x509_ctx	containing the certificates to verify.
+ * @param[in] arg	The fr_tls_conf_t the SSL_CTX was created from.
+ * @return
+ *	- 1 if the chain is valid.
+ *	- 0 if the chain is not valid.
+ */
+int tls_validate_chain_cb(X509_STORE_CTX *x509_ctx, void *arg)
+{
+	fr_tls_conf_t const		*conf = arg;
+	X509				*cert, *issuer_cert;
+	uint8_t				fingerprint[SHA256_DIGEST_LENGTH];
+	unsigned int			len = sizeof(fingerprint);
+	uint64_t			generation;
+	int				(*verify_cb)(int, X509_STORE_CTX *);
+	int				ret;
+
+	if (!conf || !conf->verify_cache) return X509_verify_cert(x509_ctx);
+
+	cert = X509_STORE_CTX_get0_cert(x509_ctx);
+	if (!cert || !X509_digest(cert, EVP_sha256(), fingerprint, &len)) return X509_verify_cert(x509_ctx);
+
+	issuer_cert = verify_cache_find(conf->verify_cache, fingerprint, &generation);
+	if (!issuer_cert) {
+		ret = X509_verify_cert(x509_ctx);
+		if ((ret == 1) && (X509_STORE_CTX_get_error(x509_ctx) == X509_V_OK)) {
+			verify_cache_insert(conf, x509_ctx, fingerprint, generation);
+		}
+		return ret;
+	}
+
+	verify_cb = X509_STORE_CTX_get_verify_cb(x509_ctx);
+
+	X509_STORE_CTX_set_error(x509_ctx, X509_V_OK);
+	X509_STORE_CTX_set_current_cert(x509_ctx, issuer_cert);
+	X509_STORE_CTX_set_error_depth(x509_ctx, 1);
+	ret = verify_cb(1, x509_ctx);
+	X509_free(issuer_cert);
+	if (!ret) goto fail;
+
+	X509_STORE_CTX_set_current_cert(x509_ctx, cert);
+	X509_STORE_CTX_set_error_depth(x509_ctx, 0);
+	ret = verify_cb(1, x509_ctx);
+	if (!ret) goto fail;
+
+	return 1;
+
+fail:
+	if (X509_STORE_CTX_get_error(x509_ctx) == X509_V_OK) {
+		X509_STORE_CTX_set_error(x509_ctx, X509_V_ERR_CERT_REJECTED);
+	}
+	return 0;
+}
+
 /** Revalidates the client's certificate chain
  *
  * Wraps the tls_validate_cert_cb callback, allowing us to use the same
@@ -378,7 +705,7 @@ int tls_validate_client_cert_chain(SSL *ssl)
 	X509_STORE_CTX_set_ex_data(store_ctx, SSL_get_ex_data_X509_STORE_CTX_idx(), ssl);
 	X509_STORE_CTX_set_verify_cb(store_ctx, tls_validate_cert_cb);
 
-	verify = X509_verify_cert(store_ctx);
+	verify = tls_validate_chain_cb(store_ctx, SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF));
 	if (verify != 1) {
 		err = X509_STORE_CTX_get_error(store_ctx);
 
@@ -150,9 +150,14 @@ static int tls_socket_recv(rad_listen_t *listener)
 
 	RDEBUG3("Reading from socket %d", request->packet->sockfd);
 	pthread_mutex_lock(&sock->mutex);
+	if (tls_record_reserve(&sock->tls_session->dirty_in, FR_TLS_MAX_RECORD_SIZE) < 0) {
+		RPERROR("Failed allocating TLS buffer");
+		goto do_close;
+	}
+
 	rcode = read(request->packet->sockfd,
 		     sock->tls_session->dirty_in.data,
-		     sizeof(sock->tls_session->dirty_in.data));
+		     sock->tls_session->dirty_in.size);
 	if ((rcode < 0) && (errno == ECONNRESET)) {
 	do_close:
 		pthread_mutex_unlock(&sock->mutex);
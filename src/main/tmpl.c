@@ -198,6 +198,12 @@ VALUE_PAIR **radius_list(REQUEST *request, pair_lists_t list)
 
 	case PAIR_LIST_REQUEST:
 		if (!request->packet) return NULL;
+
+		/*
+		 *	The caller may look at any attribute, so
+		 *	decode the ones which were left for later.
+		 */
+		if (request->packet->lazy) (void) fr_radius_packet_decode_pending(request->packet, NULL);
 		return &request->packet->vps;
 
 	case PAIR_LIST_REPLY:
@@ -2032,7 +2038,17 @@ VALUE_PAIR *tmpl_cursor_init(int *err, vp_cursor_t *cursor, REQUEST *request, vp
 		if (err) *err = -3;
 		return NULL;
 	}
-	vps = radius_list(request, vpt->tmpl_list);
+
+	/*
+	 *	Only decode the VSAs we're looking for.
+	 */
+	if ((vpt->type == TMPL_TYPE_ATTR) && (vpt->tmpl_list == PAIR_LIST_REQUEST) &&
+	    request->packet && request->packet->lazy) {
+		(void) fr_radius_packet_decode_pending(request->packet, vpt->tmpl_da);
+		vps = &request->packet->vps;
+	} else {
+		vps = radius_list(request, vpt->tmpl_list);
+	}
 	if (!vps) {
 		if (err) *err = -2;
 		return NULL;
@@ -2260,6 +2276,54 @@ int tmpl_find_vp(VALUE_PAIR **out, REQUEST *request, vp_tmpl_t const *vpt)
 
 	int err;
 
+	/*
+	 *	Most references are to the first instance of an
+	 *	attribute in one of the current request's lists.
+	 *	Go straight to the list head and search it, instead
+	 *	of setting up a cursor.
+	 */
+	if ((vpt->type == TMPL_TYPE_ATTR) && (vpt->tmpl_request == REQUEST_CURRENT) &&
+	    ((vpt->tmpl_num == NUM_ANY) || (vpt->tmpl_num == NUM_ALL) ||
+	     (vpt->tmpl_num == NUM_COUNT) || (vpt->tmpl_num == 0))) {
+		VALUE_PAIR **head;
+
+		switch (vpt->tmpl_list) {
+		case PAIR_LIST_REQUEST:
+			if (!request->packet) goto slow;
+
+			/*
+			 *	Only decode the VSAs we're looking for.
+			 */
+			if (request->packet->lazy) {
+				(void) fr_radius_packet_decode_pending(request->packet, vpt->tmpl_da);
+			}
+			head = &request->packet->vps;
+			break;
+
+		case PAIR_LIST_REPLY:
+			if (!request->reply) goto slow;
+			head = &request->reply->vps;
+			break;
+
+		case PAIR_LIST_CONTROL:
+			head = &request->control;
+			break;
+
+		case PAIR_LIST_STATE:
+			head = &request->state;
+			break;
+
+		default:
+			goto slow;
+		}
+
+		vp = fr_pair_find_by_da(*head, vpt->tmpl_da, vpt->tmpl_tag);
+		if (out) *out = vp;
+
+		return vp ? 0 : -1;
+	}
+
+slow:
 	vp = tmpl_cursor_init(&err, &cursor, request, vpt);
 	if (out) *out = vp;
 
@@ -2280,7 +2344,6 @@ int tmpl_find_vp(VALUE_PAIR **out, REQUEST *request, vp_tmpl_t const *vpt)
  */
 int tmpl_find_or_add_vp(VALUE_PAIR **out, REQUEST *request, vp_tmpl_t const *vpt)
 {
-	vp_cursor_t	cursor;
 	VALUE_PAIR	*vp;
 	int		err;
 
@@ -2289,7 +2352,7 @@ int tmpl_find_or_add_vp(VALUE_PAIR **out, REQUEST *request, vp_tmpl_t const *vpt
 
 	*out = NULL;
 
-	vp = tmpl_cursor_init(&err, &cursor, request, vpt);
+	err = tmpl_find_vp(&vp, request, vpt);
 	switch (err) {
 	case 0:
 		*out = vp;
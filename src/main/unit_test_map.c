@@ -57,6 +57,16 @@ void *module_thread_instance_find(UNUSED void *inst)
 	return NULL;
 }
 
+void *module_instance_acquire(module_generation_t **generation, UNUSED module_instance_t *mod_inst)
+{
+	*generation = NULL;
+	return NULL;
+}
+
+void module_instance_release(UNUSED module_generation_t *generation)
+{
+}
+
 /* Linker hacks */
 
 static void NEVER_RETURNS usage(void)
@@ -28,6 +28,7 @@ RCSID("$Id$")
 #include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/interpreter.h>
 #include <freeradius-devel/parser.h>
+#include <freeradius-devel/startup_trace.h>
 
 /* Here's where we recognize all of our keywords: first the rcodes, then the
  * actions */
@@ -1702,6 +1703,133 @@ static bool compile_action_subsection(unlang_t *c, CONF_SECTION *cs, CONF_SECTIO
 }
 
 
+#ifdef HAVE_REGEX
+#  ifdef HAVE_PCRE
+#    define PREFILTER_FMT "(?:%.*s)"
+#  else
+#    define PREFILTER_FMT "(%.*s)"
+#  endif
+
+/*
+ *	Return the map of an "if" or "elsif" whose condition is a
+ *	single "&Attr =~ /regex/" with a pre-compiled regex, and
+ *	which can be merged with its neighbours into a prefilter.
+ */
+static vp_map_t const *prefilter_map(unlang_t *c)
+{
+	unlang_group_t	*g;
+	vp_map_t const	*map;
+	char const	*p, *end;
+
+	if ((c->type != UNLANG_TYPE_IF) && (c->type != UNLANG_TYPE_ELSIF)) return NULL;
+
+	g = unlang_generic_to_group(c);
+	if (!g->cond || (g->cond->type != COND_TYPE_MAP) || g->cond->negate || g->cond->cast ||
+	    (g->cond->pass2_fixup == PASS2_PAIRCOMPARE)) return NULL;
+
+	map = g->cond->data.map;
+	if ((map->op != T_OP_REG_EQ) || (map->rhs->type != TMPL_TYPE_REGEX_STRUCT)) return NULL;
+
+	if ((map->lhs->type != TMPL_TYPE_ATTR) || (map->lhs->tmpl_da->type != FR_TYPE_STRING) ||
+	    (map->lhs->tmpl_num == NUM_COUNT)) return NULL;
+
+	/*
+	 *	Anything which depends on the numbering of the
+	 *	groups, or which could escape from the group we
+	 *	wrap the pattern in, can't be combined.
+	 */
+	end = map->rhs->name + map->rhs->len;
+	for (p = map->rhs->name; p < end; p++) {
+		if (*p == '\\') {
+			if ((p + 1) == end) return NULL;
+			if (isdigit((uint8_t) p[1]) || (p[1] == 'g') || (p[1] == 'k') || (p[1] == 'Q')) return NULL;
+			p++;
+			continue;
+		}
+
+		if ((*p != '(') || ((p + 1) == end)) continue;
+
+		if (p[1] == '*') return NULL;
+		if (p[1] != '?') continue;
+
+		if (((p + 2) < end) && ((p[2] == ':') || (p[2] == '=') || (p[2] == '!'))) continue;
+		if (((p + 3) < end) && (p[2] == '<') && ((p[3] == '=') || (p[3] == '!'))) continue;
+
+		return NULL;
+	}
+
+	return map;
+}
+
+static bool prefilter_same_subject(vp_map_t const *a, vp_map_t const *b)
+{
+	return ((a->lhs->tmpl_da == b->lhs->tmpl_da) &&
+		(a->lhs->tmpl_num == b->lhs->tmpl_num) &&
+		(a->lhs->tmpl_tag == b->lhs->tmpl_tag) &&
+		(a->lhs->tmpl_list == b->lhs->tmpl_list) &&
+		(a->lhs->tmpl_request == b->lhs->tmpl_request) &&
+		(a->rhs->tmpl_iflag == b->rhs->tmpl_iflag) &&
+		(a->rhs->tmpl_mflag == b->rhs->tmpl_mflag));
+}
+
+/*
+ *	Find chains of "if" / "elsif" which match the same attribute
+ *	against different regular expressions, and combine the
+ *	expressions into one.  If the combined expression doesn't
+ *	match, the interpreter can skip the whole chain with one
+ *	call to regex_exec(), instead of one call per condition.
+ *
+ *	If it does match, the conditions are evaluated as normal,
+ *	so that the first matching one is taken, and its subcaptures
+ *	are set.
+ */
+static void compile_regex_prefilter(unlang_group_t *g)
+{
+	unlang_t	*this, *next, *last;
+	vp_map_t const	*first, *map;
+	unlang_group_t	*h;
+	char		*pattern;
+	regex_t		*preg;
+	int		count;
+
+	for (this = g->children; this; this = this->next) {
+		first = prefilter_map(this);
+		if (!first) continue;
+
+		h = unlang_generic_to_group(this);
+		pattern = talloc_typed_asprintf(h, PREFILTER_FMT, (int) first->rhs->len, first->rhs->name);
+		if (!pattern) return;
+
+		last = this;
+		count = 1;
+		for (next = this->next; next && (next->type == UNLANG_TYPE_ELSIF); next = next->next) {
+			map = prefilter_map(next);
+			if (!map || !prefilter_same_subject(first, map)) break;
+
+			pattern = talloc_asprintf_append_buffer(pattern, "|" PREFILTER_FMT,
+								(int) map->rhs->len, map->rhs->name);
+			if (!pattern) return;
+
+			last = next;
+			count++;
+		}
+
+		/*
+		 *	Nothing to gain from a single condition.
+		 */
+		if ((count > 1) &&
+		    (regex_compile(h, &preg, pattern, talloc_array_length(pattern) - 1,
+				   first->rhs->tmpl_iflag, first->rhs->tmpl_mflag, false, false) > 0)) {
+			h->prefilter = preg;
+			h->prefilter_last = last;
+		}
+		talloc_free(pattern);
+
+		this = last;
+	}
+}
+#endif
+
 static unlang_t *compile_children(unlang_group_t *g, UNUSED unlang_t *parent, unlang_compile_t *unlang_ctx,
 				  unlang_group_type_t group_type, unlang_group_type_t parentgroup_type)
 {
@@ -1802,6 +1930,10 @@ static unlang_t *compile_children(unlang_group_t *g, UNUSED unlang_t *parent, un
 		}
 	}
 
+#ifdef HAVE_REGEX
+	compile_regex_prefilter(g);
+#endif
+
 	return compile_action_defaults(c, unlang_ctx, parentgroup_type);
 }
 
@@ -1832,6 +1964,121 @@ static unlang_t *compile_group(unlang_t *parent, unlang_compile_t *unlang_ctx, C
 	return compile_children(g, parent, unlang_ctx, group_type, parentgroup_type);
 }
 
+static int case_cmp(void const *one, void const *two)
+{
+	unlang_case_t const *a = one;
+	unlang_case_t const *b = two;
+
+	return fr_value_box_cmp(a->value, b->value);
+}
+
+/*
+ *	Index the "case" statements which are literal values, so the
+ *	interpreter can find the matching "case" without evaluating
+ *	each one in turn.
+ *
+ *	If we're switching over an attribute, these are the values
+ *	of that attribute's type.  If we're switching over an
+ *	expansion, they're the unquoted and quoted strings, which
+ *	are compared to the expanded string.
+ *
+ *	Anything else (xlats, attribute references, prefixes with
+ *	their "contains" comparisons) is left out of the index, and
+ *	evaluated in turn by the interpreter.
+ */
+static bool compile_case_indexable(unlang_group_t const *g, unlang_group_t const *h)
+{
+	switch (g->vpt->type) {
+	case TMPL_TYPE_ATTR:
+		return (h->vpt->type == TMPL_TYPE_DATA) && (h->vpt->tmpl_value_type == g->vpt->tmpl_da->type);
+
+	case TMPL_TYPE_XLAT_STRUCT:
+	case TMPL_TYPE_XLAT:
+	case TMPL_TYPE_EXEC:
+		return (h->vpt->type == TMPL_TYPE_UNPARSED);
+
+	default:
+		return false;
+	}
+}
+
+static void compile_switch_index(unlang_group_t *g)
+{
+	unlang_t	*this;
+	unlang_group_t	*h;
+	unlang_case_t	*entry;
+	rbtree_t	*cases;
+	int		order = 0;
+
+	switch (g->vpt->type) {
+	case TMPL_TYPE_ATTR:
+		switch (g->vpt->tmpl_da->type) {
+		case FR_TYPE_IPV4_PREFIX:
+		case FR_TYPE_IPV6_PREFIX:
+			return;
+
+		default:
+			break;
+		}
+		break;
+
+	case TMPL_TYPE_XLAT_STRUCT:
+	case TMPL_TYPE_XLAT:
+	case TMPL_TYPE_EXEC:
+		break;
+
+	default:
+		return;
+	}
+
+	cases = rbtree_create(g, case_cmp, NULL, RBTREE_FLAG_NONE);
+	if (!cases) return;
+
+	for (this = g->children; this; this = this->next, order++) {
+		h = unlang_generic_to_group(this);
+		if (!h->vpt) continue;	/* default case */
+
+		if (!compile_case_indexable(g, h)) {
+			g->dynamic_cases = true;
+			continue;
+		}
+
+		entry = talloc_zero(cases, unlang_case_t);
+		if (!entry) {
+			for (this = g->children; this; this = this->next) unlang_generic_to_group(this)->indexed = false;
+			g->dynamic_cases = false;
+			talloc_free(cases);
+			return;
+		}
+
+		if (h->vpt->type == TMPL_TYPE_DATA) {
+			entry->value = &h->vpt->tmpl_value;
+		} else {
+			entry->name.type = FR_TYPE_STRING;
+			entry->name.vb_strvalue = h->vpt->name;
+			entry->name.datum.length = h->vpt->len;
+			entry->value = &entry->name;
+		}
+		entry->instruction = this;
+		entry->order = order;
+		h->indexed = true;
+
+		/*
+		 *	Duplicate values can never match, as the
+		 *	earlier "case" is always found first.
+		 */
+		if (!rbtree_insert(cases, entry)) talloc_free(entry);
+	}
+
+	if (rbtree_num_elements(cases) == 0) {
+		g->dynamic_cases = false;
+		talloc_free(cases);
+		return;
+	}
+
+	g->cases = cases;
+}
+
 static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx, CONF_SECTION *cs,
 				   unlang_group_type_t group_type, unlang_group_type_t parentgroup_type, unlang_type_t mod_type)
 {
@@ -1928,7 +2175,12 @@ static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx,
 		return NULL;
 	}
 
-	return compile_children(g, parent, unlang_ctx, group_type, parentgroup_type);
+	c = compile_children(g, parent, unlang_ctx, group_type, parentgroup_type);
+	if (!c) return NULL;
+
+	compile_switch_index(g);
+
+	return c;
 }
 
 static unlang_t *compile_case(unlang_t *parent, unlang_compile_t *unlang_ctx, CONF_SECTION *cs,
@@ -2495,10 +2747,19 @@ static unlang_t *compile_load_balance(unlang_t *parent, unlang_compile_t *unlang
 	return c;
 }
 
+static const FR_NAME_NUMBER parallel_mode_table[] = {
+	{ "all",	UNLANG_PARALLEL_ALL	},
+	{ "first",	UNLANG_PARALLEL_FIRST	},
+	{ "any",	UNLANG_PARALLEL_ANY	},
+	{ NULL, -1 }
+};
+
 static unlang_t *compile_parallel(unlang_t *parent, unlang_compile_t *unlang_ctx, CONF_SECTION *cs,
 				      unlang_group_type_t group_type, unlang_group_type_t parentgroup_type, unlang_type_t mod_type)
 {
 	unlang_t *c;
+	char const *name2;
+	int mode = UNLANG_PARALLEL_ALL;
 
 	/*
 	 *	No children?  Die!
@@ -2508,15 +2769,30 @@ static unlang_t *compile_parallel(unlang_t *parent, unlang_compile_t *unlang_ctx
 		return NULL;
 	}
 
-	if (cf_section_name2(cs) != NULL) {
-		cf_log_err(cs, "%s sections cannot have an argument", unlang_ops[mod_type].name);
-		return NULL;
+	/*
+	 *	parallel [ all | first | any ] { ... }
+	 */
+	name2 = cf_section_name2(cs);
+	if (name2) {
+		mode = fr_str2int(parallel_mode_table, name2, -1);
+		if (mode < 0) {
+			cf_log_err(cs, "Invalid argument '%s' to %s.  Expected 'all', 'first', or 'any'",
+				   name2, unlang_ops[mod_type].name);
+			return NULL;
+		}
 	}
 
 	c = compile_group(parent, unlang_ctx, cs, group_type, parentgroup_type, mod_type);
 	if (!c) return NULL;
 
-	c->name = c->debug_name = unlang_ops[c->type].name;
+	unlang_generic_to_group(c)->parallel = mode;
+
+	c->name = unlang_ops[c->type].name;
+	if (name2) {
+		c->debug_name = talloc_asprintf(c, "%s %s", c->name, name2);
+	} else {
+		c->debug_name = c->name;
+	}
 
 	return c;
 }
@@ -3067,6 +3343,22 @@ int unlang_compile(CONF_SECTION *cs, rlm_components_t component)
 	char const *name1, *name2;
 	unlang_t *c;
 	unlang_compile_t unlang_ctx;
+	fr_startup_phase_t *trace = NULL;
+
+	if (fr_startup_trace_enabled()) {
+		CONF_SECTION *server_cs;
+
+		for (server_cs = cs; server_cs; server_cs = cf_item_to_section(cf_parent(server_cs))) {
+			if (strcmp(cf_section_name1(server_cs), "server") == 0) break;
+		}
+
+		trace = fr_startup_trace_start("unlang.compile", "%s%s%s%s%s",
+					       server_cs ? cf_section_name2(server_cs) : "",
+					       server_cs ? " " : "",
+					       cf_section_name1(cs),
+					       cf_section_name2(cs) ? " " : "",
+					       cf_section_name2(cs) ? cf_section_name2(cs) : "");
+	}
 
 	unlang_ctx.component = component;
 	unlang_ctx.name = comp2str[component];
@@ -3080,6 +3372,7 @@ int unlang_compile(CONF_SECTION *cs, rlm_components_t component)
 	}
 
 	c = compile_group(NULL, &unlang_ctx, cs, UNLANG_GROUP_TYPE_SIMPLE, UNLANG_GROUP_TYPE_SIMPLE, UNLANG_TYPE_GROUP);
+	fr_startup_trace_stop(trace);
 	if (!c) return -1;
 
 	/*
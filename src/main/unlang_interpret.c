@@ -28,6 +28,10 @@ RCSID("$Id$")
 #include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/interpreter.h>
 #include <freeradius-devel/parser.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/metrics.h>
+#include <freeradius-devel/io/trace.h>
+#include <freeradius-devel/probe.h>
 
 static FR_NAME_NUMBER unlang_action_table[] = {
 	{ "calculate-result",	UNLANG_ACTION_CALCULATE_RESULT },
@@ -156,6 +160,7 @@ static inline void unlang_push(unlang_stack_t *stack, unlang_t *program, rlm_rco
 	frame->unwind = UNLANG_TYPE_NULL;
 	frame->resume = false;
 	frame->state = NULL;
+	frame->trace_span = -1;
 }
 
 static inline void unlang_pop(unlang_stack_t *stack)
@@ -543,38 +548,320 @@ static unlang_action_t unlang_fork(REQUEST *request, unlang_stack_t *stack,
 	return UNLANG_ACTION_CALCULATE_RESULT;
 }
 
+/** Where a child of a "parallel" section is up to
+ *
+ */
+typedef enum {
+	UNLANG_PARALLEL_CHILD_INIT = 0,		//!< Not yet run.
+	UNLANG_PARALLEL_CHILD_YIELDED,		//!< Waiting for an event.
+	UNLANG_PARALLEL_CHILD_DONE		//!< Finished, or cancelled.
+} unlang_parallel_child_state_t;
+
+typedef struct {
+	unlang_parallel_child_state_t	state;		//!< Of the child.
+	REQUEST				*child;		//!< Child request.
+	unlang_t			*instruction;	//!< The child's section of the "parallel".
+} unlang_parallel_child_t;
+
 typedef struct unlang_parallel_t {
-	rlm_rcode_t	rcode;
-	int		priority;
+	rlm_rcode_t		result;		//!< Merged result of the children.
+	int			priority;	//!< Priority of the merged result.
 
-	unlang_stack_t	*stacks;
+	bool			done;		//!< The result is known, cancel everything else.
+	int			num_children;
+	int			num_yielded;	//!< Children waiting for an event.
+
+	fr_heap_t		*runnable;	//!< Children which have been marked resumable.
+
+	unlang_parallel_child_t	children[];
 } unlang_parallel_t;
 
-static unlang_action_t unlang_parallel(UNUSED REQUEST *request, unlang_stack_t *stack,
-				       UNUSED rlm_rcode_t *result, UNUSED int *priority)
+static int unlang_parallel_child_cmp(void const *one, void const *two)
+{
+	return (one > two) - (one < two);
+}
+
+/** Give the parent's packets and lists to a child, so that it can run
+ *
+ * The children of a "parallel" section all work on the parent's
+ * packets and lists.  Only one child runs at a time, so the child
+ * which is running takes ownership of them, and gives them back when
+ * it finishes, or yields.
+ *
+ * The packet pointers are left in the parent, so that the child can
+ * still refer to its parent's attributes.
+ */
+static void unlang_parallel_child_enter(REQUEST *request, REQUEST *child)
+{
+	VALUE_PAIR *vp;
+
+	child->packet = talloc_steal(child, request->packet);
+	child->reply = talloc_steal(child, request->reply);
+
+	for (vp = request->control; vp; vp = vp->next) (void) talloc_steal(child, vp);
+	child->control = request->control;
+	request->control = NULL;
+
+	for (vp = request->state; vp; vp = vp->next) (void) talloc_steal(child->state_ctx, vp);
+	child->state = request->state;
+	request->state = NULL;
+
+	child->username = request->username;
+	child->password = request->password;
+}
+
+/** Take the packets and lists back from a child
+ *
+ * This includes any attributes which the child allocated in its own
+ * context.
+ */
+static void unlang_parallel_child_leave(REQUEST *request, REQUEST *child)
+{
+	VALUE_PAIR *vp;
+
+	request->packet = talloc_steal(request, child->packet);
+	request->reply = talloc_steal(request, child->reply);
+	child->packet = NULL;
+	child->reply = NULL;
+
+	for (vp = child->control; vp; vp = vp->next) (void) talloc_steal(request, vp);
+	request->control = child->control;
+	child->control = NULL;
+
+	for (vp = child->state; vp; vp = vp->next) (void) talloc_steal(request->state_ctx, vp);
+	request->state = child->state;
+	child->state = NULL;
+
+	request->username = child->username;
+	request->password = child->password;
+	child->username = NULL;
+	child->password = NULL;
+}
+
+/** Merge the result of a child into the result of the "parallel" section
+ *
+ */
+static void unlang_parallel_child_result(unlang_parallel_t *state, unlang_parallel_mode_t mode,
+					 unlang_parallel_child_t *pc, rlm_rcode_t result)
+{
+	int priority;
+
+	if (result == RLM_MODULE_UNKNOWN) return;
+
+	priority = pc->instruction->actions[result];
+
+	/*
+	 *	"return" and "reject" win outright, and stop the
+	 *	other children, exactly as they stop the rest of a
+	 *	group.  Except for "any", where a later child may
+	 *	still succeed.
+	 */
+	if (priority < 0) {
+		if (priority == MOD_ACTION_REJECT) result = RLM_MODULE_REJECT;
+		priority = MOD_PRIORITY_MAX;
+		if (mode == UNLANG_PARALLEL_ALL) state->done = true;
+	}
+
+	switch (mode) {
+	case UNLANG_PARALLEL_FIRST:
+		state->done = true;
+		break;
+
+	case UNLANG_PARALLEL_ANY:
+		if ((result == RLM_MODULE_OK) || (result == RLM_MODULE_UPDATED)) {
+			state->result = result;
+			state->priority = priority;
+			state->done = true;
+			return;
+		}
+		break;
+
+	case UNLANG_PARALLEL_ALL:
+		break;
+	}
+
+	if (state->done || (priority > state->priority)) {
+		state->result = result;
+		state->priority = priority;
+	}
+}
+
+/** Run one child until it finishes, or yields
+ *
+ */
+static void unlang_parallel_child_run(REQUEST *request, unlang_parallel_t *state, unlang_parallel_mode_t mode,
+				      unlang_parallel_child_t *pc)
+{
+	REQUEST		*child = pc->child;
+	rlm_rcode_t	result;
+
+	if (pc->state == UNLANG_PARALLEL_CHILD_YIELDED) state->num_yielded--;
+
+	child->log.unlang_indent = request->log.unlang_indent;
+	unlang_parallel_child_enter(request, child);
+	result = unlang_run(child, child->stack);
+	unlang_parallel_child_leave(request, child);
+
+	if (result == RLM_MODULE_YIELD) {
+		pc->state = UNLANG_PARALLEL_CHILD_YIELDED;
+		state->num_yielded++;
+		return;
+	}
+
+	pc->state = UNLANG_PARALLEL_CHILD_DONE;
+	TALLOC_FREE(pc->child);
+
+	unlang_parallel_child_result(state, mode, pc, result);
+}
+
+/** Stop all of the children which are still waiting for an event
+ *
+ */
+static void unlang_parallel_cancel(REQUEST *request, unlang_parallel_t *state)
+{
+	int i;
+
+	for (i = 0; i < state->num_children; i++) {
+		unlang_parallel_child_t *pc = &state->children[i];
+
+		if (pc->state == UNLANG_PARALLEL_CHILD_YIELDED) {
+			RDEBUG3("parallel - cancelling child %d", i);
+
+			if (pc->child->heap_id >= 0) (void) fr_heap_extract(state->runnable, pc->child);
+			unlang_parallel_child_enter(request, pc->child);
+			unlang_signal(pc->child, FR_ACTION_DONE);
+			unlang_parallel_child_leave(request, pc->child);
+			TALLOC_FREE(pc->child);
+			state->num_yielded--;
+		}
+
+		pc->state = UNLANG_PARALLEL_CHILD_DONE;
+	}
+}
+
+/** Fork a child request for each section of the "parallel", and run them
+ *
+ * The children all share the parent's event list.  When one of them
+ * is marked resumable, it's put into our runnable heap, and the parent
+ * is scheduled.  The parent then resumes the children which are
+ * runnable.
+ */
+static unlang_action_t unlang_parallel(REQUEST *request, unlang_stack_t *stack,
+				       rlm_rcode_t *presult, int *ppriority)
 {
 	unlang_stack_frame_t	*frame = &stack->frame[stack->depth];
 	unlang_t		*instruction = frame->instruction;
-	unlang_group_t	*g;
+	unlang_group_t		*g;
+	unlang_parallel_t	*state;
+	REQUEST			*child;
+	int			i;
 
 	g = unlang_generic_to_group(instruction);
 
 	if (!frame->resume) {
+		unlang_t *c;
+
+		state = talloc_zero_size(stack, sizeof(*state) + (sizeof(state->children[0]) * g->num_children));
+		if (!state) {
+		fail:
+			*presult = RLM_MODULE_FAIL;
+			return UNLANG_ACTION_CALCULATE_RESULT;
+		}
+		talloc_set_type(state, unlang_parallel_t);
+
+		state->result = RLM_MODULE_NOOP;
+		state->priority = -1;
+		state->runnable = fr_heap_create(unlang_parallel_child_cmp, offsetof(REQUEST, heap_id));
+		if (!state->runnable) {
+			talloc_free(state);
+			goto fail;
+		}
+		talloc_steal(state, state->runnable);
+
 		/*
-		 *	Set up some stacks and a return code.
+		 *	Create all of the children before running
+		 *	any of them, so that they all start with the
+		 *	same environment.
 		 */
+		for (c = g->children, i = 0; c && (i < g->num_children); c = c->next, i++) {
+			child = request_alloc_fake(request);
+			if (!child) {
+				talloc_free(state);
+				goto fail;
+			}
+			talloc_steal(state, child);
+
+			/*
+			 *	The child uses the parent's packets,
+			 *	instead of the empty ones it was given.
+			 */
+			TALLOC_FREE(child->packet);
+			TALLOC_FREE(child->reply);
+
+			child->el = request->el;
+			child->backlog = state->runnable;
+			child->async = request->async;
+
+			unlang_push(child->stack, NULL, RLM_MODULE_UNKNOWN, UNLANG_NEXT_STOP, UNLANG_TOP_FRAME);
+			unlang_push(child->stack, c, RLM_MODULE_UNKNOWN, UNLANG_NEXT_STOP, UNLANG_SUB_FRAME);
+
+			state->children[i].child = child;
+			state->children[i].instruction = c;
+		}
+		state->num_children = i;
+
+		frame->state = state;
+
+		for (i = 0; (i < state->num_children) && !state->done; i++) {
+			unlang_parallel_child_run(request, state, g->parallel, &state->children[i]);
+		}
+
 	} else {
-		/*
-		 *	Find a resumption child and run it.
-		 */
+		state = talloc_get_type_abort(frame->state, unlang_parallel_t);
+
+		while (!state->done && ((child = fr_heap_pop(state->runnable)) != NULL)) {
+			for (i = 0; i < state->num_children; i++) {
+				if (state->children[i].child == child) break;
+			}
+			rad_assert(i < state->num_children);
+
+			unlang_parallel_child_run(request, state, g->parallel, &state->children[i]);
+		}
 	}
 
 	/*
-	 *	@todo fork child requests and make them top frames
+	 *	Some children are still waiting for events, wait
+	 *	with them.
 	 */
-	unlang_push(stack, g->children, frame->result, UNLANG_NEXT_CONTINUE, UNLANG_SUB_FRAME);
+	if (!state->done && (state->num_yielded > 0)) {
+		*presult = RLM_MODULE_YIELD;
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
 
-	return UNLANG_ACTION_PUSHED_CHILD;
+	unlang_parallel_cancel(request, state);
+
+	*presult = state->result;
+	*ppriority = (state->priority > MOD_PRIORITY_MAX) ? MOD_PRIORITY_MAX : state->priority;
+
+	talloc_free(state);
+	frame->state = NULL;
+
+	return UNLANG_ACTION_CALCULATE_RESULT;
+}
+
+/** Pass a signal to all of the children of a "parallel" section
+ *
+ */
+static void unlang_parallel_signal(unlang_stack_frame_t *frame, fr_state_action_t action)
+{
+	unlang_parallel_t	*state = talloc_get_type_abort(frame->state, unlang_parallel_t);
+	int			i;
+
+	for (i = 0; i < state->num_children; i++) {
+		if (state->children[i].state != UNLANG_PARALLEL_CHILD_YIELDED) continue;
+
+		unlang_signal(state->children[i].child, action);
+	}
 }
 
 static unlang_action_t unlang_case(REQUEST *request, unlang_stack_t *stack,
@@ -774,6 +1061,7 @@ static unlang_action_t unlang_switch(REQUEST *request, unlang_stack_t *stack,
 	unlang_t		*instruction = frame->instruction;
 	unlang_t		*this, *found, *null_case;
 	unlang_group_t		*g, *h;
+	unlang_case_t		*best = NULL;
 	fr_cond_t		cond;
 	fr_value_box_t		data;
 	vp_map_t		map;
@@ -831,6 +1119,48 @@ static unlang_action_t unlang_switch(REQUEST *request, unlang_stack_t *stack,
 		tmpl_init(&vpt, TMPL_TYPE_UNPARSED, data.vb_strvalue, len, T_SINGLE_QUOTED_STRING);
 	}
 
+	/*
+	 *	The literal "case" statements have been indexed by
+	 *	value.  Look up the expanded string, or each instance
+	 *	of the attribute, and use the first "case" which
+	 *	matches any of them.
+	 */
+	if (g->cases) {
+		unlang_case_t	my_case, *entry;
+
+		if (g->vpt->type == TMPL_TYPE_ATTR) {
+			VALUE_PAIR	*vp;
+			vp_cursor_t	cursor;
+			int		err;
+
+			for (vp = tmpl_cursor_init(&err, &cursor, request, g->vpt);
+			     vp;
+			     vp = tmpl_cursor_next(&cursor, g->vpt)) {
+				my_case.value = &vp->data;
+
+				entry = rbtree_finddata(g->cases, &my_case);
+				if (entry && (!best || (entry->order < best->order))) best = entry;
+			}
+		} else {
+			my_case.name.type = FR_TYPE_STRING;
+			my_case.name.vb_strvalue = vpt.name;
+			my_case.name.datum.length = vpt.len;
+			my_case.value = &my_case.name;
+
+			best = rbtree_finddata(g->cases, &my_case);
+		}
+
+		/*
+		 *	Every "case" is in the index, so we're done.
+		 */
+		if (!g->dynamic_cases) {
+			if (!best) goto find_null_case;
+
+			found = best->instruction;
+			goto do_null_case;
+		}
+	}
+
 	/*
 	 *	Find either the exact matching name, or the
 	 *	"case {...}" statement.
@@ -848,6 +1178,19 @@ static unlang_action_t unlang_switch(REQUEST *request, unlang_stack_t *stack,
 			continue;
 		}
 
+		/*
+		 *	An indexed "case" is either the match we
+		 *	found, or can't match.  Only the ones before
+		 *	it have to be evaluated.
+		 */
+		if (h->indexed) {
+			if (best && (this == best->instruction)) {
+				found = this;
+				break;
+			}
+			continue;
+		}
+
 		/*
 		 *	If we're switching over an attribute
 		 *	AND we haven't pre-parsed the data for
@@ -945,6 +1288,70 @@ static unlang_action_t unlang_map(REQUEST *request, unlang_stack_t *stack,
 	return UNLANG_ACTION_CALCULATE_RESULT;
 }
 
+/** Release the generation of a module's instance data when the module call is done
+ *
+ */
+static int _modcall_state_free(unlang_stack_state_modcall_t *modcall_state)
+{
+	module_instance_release(modcall_state->generation);
+
+	return 0;
+}
+
+/** Count the result of a module call, and how long it took
+ *
+ */
+static inline void unlang_module_metrics(unlang_stack_state_modcall_t *modcall_state, rlm_rcode_t rcode)
+{
+	fr_metric_set_t *ms = modcall_state->thread->metrics;
+
+	if (!ms) return;
+
+	fr_metric_time(ms, MODULE_METRIC_LATENCY, fr_time() - modcall_state->start);
+	if (rcode < RLM_MODULE_NUMCODES) fr_metric_inc(ms, MODULE_METRIC_RCODE + rcode);
+}
+
+/** Count the time spent running a module
+ *
+ *  "yielded" is set to when the module was called, or resumed.  If
+ *  the module yields, it's then when the module yielded.
+ */
+static inline void unlang_module_run_time(unlang_stack_state_modcall_t *modcall_state, rlm_rcode_t rcode)
+{
+	fr_time_t now;
+
+	if (!modcall_state->thread->metrics) return;
+
+	now = fr_time();
+	fr_metric_add(modcall_state->thread->metrics, MODULE_METRIC_RUN_TIME, now - modcall_state->yielded);
+	if (rcode == RLM_MODULE_YIELD) modcall_state->yielded = now;
+}
+
+/** Note that a module call has yielded, or finished, in the trace
+ *
+ */
+static inline void unlang_module_trace(REQUEST *request, unlang_stack_state_modcall_t *modcall_state, bool yielded)
+{
+	if ((modcall_state->trace_span < 0) || !request->async || !request->async->trace) return;
+
+	if (yielded) {
+		fr_trace_span_yield(request->async->trace, modcall_state->trace_span, fr_time());
+		return;
+	}
+
+	fr_trace_span_end(request->async->trace, modcall_state->trace_span, fr_time());
+}
+
+/** Whether a request, or the request it's a child of, is a mirrored packet
+ *
+ */
+static inline bool unlang_request_is_shadow(REQUEST *request)
+{
+	while (request->parent) request = request->parent;
+
+	return request->async && request->async->listen && request->async->listen->shadow;
+}
+
 static unlang_action_t unlang_module_call(REQUEST *request, unlang_stack_t *stack,
 				     	  rlm_rcode_t *presult, int *priority)
 {
@@ -980,6 +1387,17 @@ static unlang_action_t unlang_module_call(REQUEST *request, unlang_stack_t *stac
 		goto done;
 	}
 
+	/*
+	 *	Mirrored packets mustn't write to databases, send
+	 *	packets, etc.  The production server has already
+	 *	done that for the original.
+	 */
+	if (!(sp->module_instance->module->type & RLM_TYPE_SHADOW_SAFE) && unlang_request_is_shadow(request)) {
+		RDEBUG2("Not calling %s for mirrored packet", sp->module_instance->name);
+		request->rcode = RLM_MODULE_NOOP;
+		goto done;
+	}
+
 	frame->state = modcall_state = talloc_zero(stack, unlang_stack_state_modcall_t);
 
 	/*
@@ -988,20 +1406,45 @@ static unlang_action_t unlang_module_call(REQUEST *request, unlang_stack_t *stac
 	modcall_state->thread = module_thread_instance_find(sp->module_instance);
 	rad_assert(modcall_state->thread != NULL);
 
+	/*
+	 *	If the module is reloaded while we're yielded, we
+	 *	carry on with the instance data we started with.
+	 */
+	modcall_state->inst = module_instance_acquire(&modcall_state->generation, sp->module_instance);
+	if (modcall_state->generation) talloc_set_destructor(modcall_state, _modcall_state_free);
+
 	/*
 	 *	For logging unresponsive children.
 	 */
 	request->module = sp->module_instance->name;
 	modcall_state->thread->total_calls++;
+	if (modcall_state->thread->metrics) {
+		fr_metric_inc(modcall_state->thread->metrics, MODULE_METRIC_CALLS);
+		modcall_state->start = modcall_state->yielded = fr_time();
+	}
+
+	modcall_state->trace_span = -1;
+	if (request->async && request->async->trace) {
+		char name[FR_TRACE_NAME_LEN];
+
+		snprintf(name, sizeof(name), "module %s", sp->module_instance->name);
+		modcall_state->trace_span = fr_trace_span_start(request->async->trace, name,
+								 sp->module_instance->module->name, fr_time());
+	}
+
+	if (request->async) request->async->module = request->module;
+
+	FR_PROBE2(module_call, request->number, sp->module_instance->name);
 
 	/*
 	 *	Lock is noop unless instance->mutex is set.
 	 */
 	safe_lock(sp->module_instance);
-	*presult = request->rcode = sp->method(sp->module_instance->dl_inst->data, modcall_state->thread->data, request);
+	*presult = request->rcode = sp->method(modcall_state->inst, modcall_state->thread->data, request);
 	safe_unlock(sp->module_instance);
 
 	request->module = NULL;
+	unlang_module_run_time(modcall_state, *presult);
 
 	/*
 	 *	Is now marked as "stop" when it wasn't before, we must have been blocked.
@@ -1014,7 +1457,15 @@ static unlang_action_t unlang_module_call(REQUEST *request, unlang_stack_t *stac
 
 	if (*presult == RLM_MODULE_YIELD) {
 		modcall_state->thread->active_callers++;
+		if (modcall_state->thread->metrics) fr_metric_inc(modcall_state->thread->metrics, MODULE_METRIC_ACTIVE);
+		unlang_module_trace(request, modcall_state, true);
+		FR_PROBE2(module_yield, request->number, sp->module_instance->name);
 	} else {
+		unlang_module_metrics(modcall_state, *presult);
+		unlang_module_trace(request, modcall_state, false);
+		if (request->async) request->async->module = NULL;
+		FR_PROBE3(module_return, request->number, sp->module_instance->name, *presult);
+
 		rad_assert(unlang_indent == request->log.unlang_indent);
 
 		rad_assert(*presult >= RLM_MODULE_REJECT);
@@ -1031,6 +1482,41 @@ done:
 }
 
 
+#ifdef HAVE_REGEX
+/** Check whether any of the regular expressions in a chain of conditions can match
+ *
+ * @return
+ *	- true if one may match, and the conditions should be evaluated.
+ *	- false if none of them match.
+ */
+static bool unlang_if_prefilter(REQUEST *request, unlang_group_t const *g)
+{
+	vp_map_t const	*map = g->cond->data.map;
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+	bool		found = false;
+
+	for (vp = tmpl_cursor_init(NULL, &cursor, request, map->lhs);
+	     vp;
+	     vp = tmpl_cursor_next(&cursor, map->lhs)) {
+		if (regex_exec(g->prefilter, vp->vp_strvalue, vp->vp_length, NULL, NULL) != 0) return true;
+		found = true;
+	}
+
+	/*
+	 *	Let the conditions deal with missing attributes.
+	 */
+	if (!found) return true;
+
+	/*
+	 *	As the failed regular expressions would have.
+	 */
+	regex_sub_to_request(request, NULL, NULL, 0, NULL, 0);
+
+	return false;
+}
+#endif
+
 static unlang_action_t unlang_if(REQUEST *request, unlang_stack_t *stack,
 				   rlm_rcode_t *presult, int *priority)
 {
@@ -1042,6 +1528,24 @@ static unlang_action_t unlang_if(REQUEST *request, unlang_stack_t *stack,
 	g = unlang_generic_to_group(instruction);
 	rad_assert(g->cond != NULL);
 
+#ifdef HAVE_REGEX
+	/*
+	 *	None of the conditions in this chain can match.  Skip
+	 *	straight past them, as if each had been evaluated.
+	 */
+	if (g->prefilter && (frame->next == instruction->next) && !unlang_if_prefilter(request, g)) {
+		RDEBUG2("...");
+		RDEBUG3("No regular expression matches, skipping to the end of \"%s\"",
+			g->prefilter_last->debug_name);
+
+		if (*presult != RLM_MODULE_UNKNOWN) *priority = g->prefilter_last->actions[*presult];
+
+		frame->next = g->prefilter_last->next;
+
+		return UNLANG_ACTION_CONTINUE;
+	}
+#endif
+
 	condition = cond_eval(request, *presult, 0, g->cond);
 	if (condition < 0) {
 		switch (condition) {
@@ -1106,14 +1610,32 @@ static unlang_action_t unlang_module_resumption(REQUEST *request, unlang_stack_t
 	memcpy(&mutable, &mr->ctx, sizeof(mutable));
 	request->module = sp->module_instance->name;
 
+	FR_PROBE2(module_resume, request->number, sp->module_instance->name);
+
+	if ((modcall_state->trace_span >= 0) && request->async && request->async->trace) {
+		fr_trace_span_resume(request->async->trace, modcall_state->trace_span, fr_time());
+	}
+
+	/*
+	 *	Count the time we were yielded, and start counting
+	 *	the time we're running.
+	 */
+	if (modcall_state->thread->metrics) {
+		fr_time_t now = fr_time();
+
+		fr_metric_add(modcall_state->thread->metrics, MODULE_METRIC_YIELD_TIME, now - modcall_state->yielded);
+		modcall_state->yielded = now;
+	}
+
 	/*
 	 *	Lock is noop unless instance->mutex is set.
 	 */
 	safe_lock(sp->module_instance);
-	*presult = request->rcode = mr->callback(request, mr->module.module_instance->dl_inst->data, mr->thread->data, mutable);
+	*presult = request->rcode = mr->callback(request, modcall_state->inst, mr->thread->data, mutable);
 	safe_unlock(sp->module_instance);
 
 	request->module = NULL;
+	unlang_module_run_time(modcall_state, *presult);
 
 	/*
 	 *	Leave mr alone, it will be freed when the request is done.
@@ -1130,10 +1652,18 @@ static unlang_action_t unlang_module_resumption(REQUEST *request, unlang_stack_t
 
 	if (*presult != RLM_MODULE_YIELD) {
 		modcall_state->thread->active_callers--;
+		if (modcall_state->thread->metrics) fr_metric_dec(modcall_state->thread->metrics, MODULE_METRIC_ACTIVE);
+		unlang_module_metrics(modcall_state, *presult);
+		unlang_module_trace(request, modcall_state, false);
+		if (request->async) request->async->module = NULL;
+		FR_PROBE3(module_return, request->number, sp->module_instance->name, *presult);
 
 		rad_assert(*presult >= RLM_MODULE_REJECT);
 		rad_assert(*presult < RLM_MODULE_NUMCODES);
 		*priority = instruction->actions[*presult];
+	} else {
+		unlang_module_trace(request, modcall_state, true);
+		FR_PROBE2(module_yield, request->number, sp->module_instance->name);
 	}
 
 	*presult = request->rcode;
@@ -1251,6 +1781,326 @@ unlang_op_t unlang_ops[] = {
 	[UNLANG_TYPE_MAX] = { NULL, NULL, false }
 };
 
+/*
+ *	Profiling of unlang.
+ *
+ *	When enabled, the time spent in the code of each instruction
+ *	(not including its children) is recorded in a table owned by
+ *	the thread running the instruction.  Only that thread writes
+ *	to the table.  The tables are read by radmin without locking,
+ *	so the counters may be slightly out of date, but every field
+ *	is word sized.
+ *
+ *	With a sample rate of N, only one in N instructions is timed,
+ *	and its counters are scaled up by N.
+ */
+#define UNLANG_PROFILE_SLOTS	(4096)
+
+typedef struct {
+	unlang_t		*parent;	//!< Of the instruction.
+	char const		*name;		//!< debug_name of the instruction.  The same for
+						//!< a module call, and its resumptions.
+	CONF_SECTION const	*cs;		//!< Where the instruction was defined, if it's a section.
+	uint64_t		calls;		//!< How many times the instruction was run.
+	uint64_t		time;		//!< Nanoseconds spent in the instruction itself.
+	uint64_t		yields;		//!< How many times the instruction yielded.
+} unlang_profile_slot_t;
+
+typedef struct unlang_profile_t {
+	struct unlang_profile_t	*next;		//!< Table of the next thread.
+	uint32_t		generation;	//!< Which run of the profiler the data is for.
+	uint64_t		dropped;	//!< Samples we had no slot for.
+	unlang_profile_slot_t	slot[UNLANG_PROFILE_SLOTS];
+} unlang_profile_t;
+
+static uint32_t unlang_profile_rate;		//!< 0 if profiling is disabled.
+static uint32_t unlang_profile_generation;	//!< Incremented each time the profiler is started.
+
+static unlang_profile_t *unlang_profile_list;	//!< Tables of all threads.
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t unlang_profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static _Thread_local unlang_profile_t *unlang_profile_thread;
+static _Thread_local uint32_t unlang_profile_count;
+
+/** Start profiling unlang instructions
+ *
+ * Any previously collected data is discarded.
+ *
+ * @param[in] rate	Time one in rate instructions.  1 times every instruction.
+ */
+void unlang_profile_start(uint32_t rate)
+{
+	unlang_profile_rate = 0;
+	unlang_profile_generation++;
+	unlang_profile_rate = rate ? rate : 1;
+}
+
+/** Stop profiling unlang instructions
+ *
+ * The data collected so far is kept, until the profiler is started again.
+ */
+void unlang_profile_stop(void)
+{
+	unlang_profile_rate = 0;
+}
+
+/** Return the table of the current thread, for the current run of the profiler
+ *
+ */
+static unlang_profile_t *unlang_profile_table(void)
+{
+	unlang_profile_t *table = unlang_profile_thread;
+
+	if (table && (table->generation == unlang_profile_generation)) return table;
+
+	if (!table) {
+		table = talloc_zero(NULL, unlang_profile_t);
+		if (!table) return NULL;
+
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_lock(&unlang_profile_mutex);
+#endif
+		table->next = unlang_profile_list;
+		unlang_profile_list = table;
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_unlock(&unlang_profile_mutex);
+#endif
+		unlang_profile_thread = table;
+	} else {
+		memset(table->slot, 0, sizeof(table->slot));
+		table->dropped = 0;
+	}
+	table->generation = unlang_profile_generation;
+
+	return table;
+}
+
+/** Decide whether the next instruction should be timed
+ *
+ */
+static inline bool unlang_profile_sample(void)
+{
+	if (++unlang_profile_count < unlang_profile_rate) return false;
+
+	unlang_profile_count = 0;
+	return true;
+}
+
+/** Record the time spent running an instruction
+ *
+ * @param[in] instruction	which was run.
+ * @param[in] start		when it started running.
+ * @param[in] yielded		whether it yielded.
+ */
+static void unlang_profile_record(unlang_t *instruction, fr_time_t start, bool yielded)
+{
+	unlang_profile_t	*table;
+	unlang_profile_slot_t	*slot;
+	uint64_t		hash, rate = unlang_profile_rate;
+	unsigned int		i, idx;
+
+	if (!rate) return;
+
+	table = unlang_profile_table();
+	if (!table) return;
+
+	hash = (((uintptr_t) instruction->parent) >> 3) ^ (((uintptr_t) instruction->debug_name) >> 3);
+	hash *= UINT64_C(0x9e3779b97f4a7c15);
+	idx = hash >> 52;	/* 4096 slots */
+
+	for (i = 0; i < UNLANG_PROFILE_SLOTS; i++, idx = (idx + 1) & (UNLANG_PROFILE_SLOTS - 1)) {
+		slot = &table->slot[idx];
+
+		if (!slot->name) {
+			slot->parent = instruction->parent;
+			slot->cs = ((instruction->type > UNLANG_TYPE_MODULE_CALL) &&
+				    (instruction->type <= UNLANG_TYPE_POLICY)) ?
+				unlang_generic_to_group(instruction)->cs : NULL;
+			slot->name = instruction->debug_name;
+		} else if ((slot->name != instruction->debug_name) || (slot->parent != instruction->parent)) {
+			continue;
+		}
+
+		slot->calls += rate;
+		slot->time += (fr_time() - start) * rate;
+		if (yielded) slot->yields += rate;
+		return;
+	}
+
+	table->dropped++;
+}
+
+/** Print the name of a frame for a flame graph
+ *
+ */
+static char *unlang_profile_frame(char *out, char const *name, CONF_SECTION const *cs)
+{
+	char *p;
+	size_t len = talloc_array_length(out) - 1;
+
+	if (cs && cf_filename(cs)) {
+		out = talloc_asprintf_append_buffer(out, "%s [%s:%d]", name ? name : "?",
+						    cf_filename(cs), cf_lineno(cs));
+	} else {
+		out = talloc_asprintf_append_buffer(out, "%s", name ? name : "?");
+	}
+	if (!out) return NULL;
+
+	/*
+	 *	';' separates frames, so can't appear in a name.
+	 */
+	for (p = out + len; *p; p++) if (*p == ';') *p = ',';
+
+	return out;
+}
+
+static char *unlang_profile_stack(char *out, unlang_t *instruction)
+{
+	if (!instruction) return out;
+
+	out = unlang_profile_stack(out, instruction->parent);
+	if (!out) return NULL;
+
+	out = unlang_profile_frame(out, instruction->debug_name,
+				   ((instruction->type > UNLANG_TYPE_MODULE_CALL) &&
+				    (instruction->type <= UNLANG_TYPE_POLICY)) ?
+				   unlang_generic_to_group(instruction)->cs : NULL);
+	if (!out) return NULL;
+
+	return talloc_strdup_append_buffer(out, ";");
+}
+
+static int unlang_profile_slot_cmp(void const *one, void const *two)
+{
+	unlang_profile_slot_t const *a = one, *b = two;
+
+	if (a->parent != b->parent) return (a->parent > b->parent) - (a->parent < b->parent);
+
+	return (a->name > b->name) - (a->name < b->name);
+}
+
+typedef struct {
+	char			*out;
+	unlang_profile_metric_t	metric;
+} unlang_profile_print_t;
+
+static int _unlang_profile_print(void *ctx, void *data)
+{
+	unlang_profile_print_t	*print = ctx;
+	unlang_profile_slot_t	*slot = data;
+	uint64_t		value;
+
+	switch (print->metric) {
+	default:
+	case UNLANG_PROFILE_TIME:
+		value = slot->time / 1000;
+		break;
+
+	case UNLANG_PROFILE_CALLS:
+		value = slot->calls;
+		break;
+
+	case UNLANG_PROFILE_YIELDS:
+		value = slot->yields;
+		break;
+	}
+
+	print->out = unlang_profile_stack(print->out, slot->parent);
+	if (print->out) print->out = unlang_profile_frame(print->out, slot->name, slot->cs);
+	if (print->out) print->out = talloc_asprintf_append_buffer(print->out, " %" PRIu64 "\n", value);
+
+	return print->out ? 0 : -1;
+}
+
+/** Print the profile in the "collapsed stack" format used by flamegraph.pl
+ *
+ * Each line is the path from the virtual server section to an
+ * instruction, with the frames separated by ';', followed by a
+ * space, and the value of the counter for that instruction.  The
+ * counters of all threads are summed.
+ *
+ * @param[in] ctx	to allocate the output in.
+ * @param[in] metric	which counter to print.  Time is printed in microseconds.
+ * @return
+ *	- The profile.  An empty string if there is no data.
+ *	- NULL on error.
+ */
+char *unlang_profile_collapsed(TALLOC_CTX *ctx, unlang_profile_metric_t metric)
+{
+	unlang_profile_t	*table;
+	unlang_profile_slot_t	*slot, *found;
+	rbtree_t		*merged;
+	unlang_profile_print_t	ctx_print;
+	unsigned int		i;
+
+	merged = rbtree_create(NULL, unlang_profile_slot_cmp, NULL, RBTREE_FLAG_NONE);
+	if (!merged) return NULL;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&unlang_profile_mutex);
+#endif
+	for (table = unlang_profile_list; table; table = table->next) {
+		if (table->generation != unlang_profile_generation) continue;
+
+		for (i = 0; i < UNLANG_PROFILE_SLOTS; i++) {
+			if (!table->slot[i].name) continue;
+
+			found = rbtree_finddata(merged, &table->slot[i]);
+			if (found) {
+				found->calls += table->slot[i].calls;
+				found->time += table->slot[i].time;
+				found->yields += table->slot[i].yields;
+				continue;
+			}
+
+			slot = talloc(merged, unlang_profile_slot_t);
+			if (!slot) break;
+			*slot = table->slot[i];
+			if (!rbtree_insert(merged, slot)) talloc_free(slot);
+		}
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&unlang_profile_mutex);
+#endif
+
+	ctx_print.out = talloc_strdup(ctx, "");
+	ctx_print.metric = metric;
+	if (ctx_print.out) (void) rbtree_walk(merged, RBTREE_IN_ORDER, _unlang_profile_print, &ctx_print);
+	talloc_free(merged);
+
+	return ctx_print.out;
+}
+
+/** Stop a request which has used up the CPU budget of its virtual server
+ *
+ * Called after each instruction, so the instruction which used up the
+ * budget is the one which is logged.  The request is stopped at the
+ * next instruction boundary, and fails without a reply.
+ */
+static void unlang_cpu_budget_check(REQUEST *request, unlang_t const *instruction)
+{
+	fr_time_tracking_t const	*tt = &request->async->tracking;
+	fr_time_t			now, used;
+	REQUEST				*r;
+
+	if (request->master_state == REQUEST_STOP_PROCESSING) return;
+
+	now = fr_time();
+	used = tt->running + ((now > tt->resumed) ? now - tt->resumed : 0);
+	if (used <= request->async->cpu_budget) return;
+
+	RERROR("CPU budget of %" PRIu64 "us exceeded (%" PRIu64 "us used) after \"%s\", stopping request",
+	       request->async->cpu_budget / 1000, used / 1000, instruction->debug_name);
+
+	/*
+	 *	Subrequests share the async state of their
+	 *	parent, so the whole request is over budget.
+	 */
+	for (r = request; r; r = r->parent) r->master_state = REQUEST_STOP_PROCESSING;
+}
+
 /*
  *	Interpret the various types of blocks.
  */
@@ -1327,11 +2177,22 @@ resume_subsection:
 		RDEBUG4("** [%i] %s >> %s", stack->depth, __FUNCTION__,
 			unlang_ops[instruction->type].name);
 
-		action = unlang_ops[instruction->type].func(request, stack, &result, &priority);
+		if (unlikely(unlang_profile_rate != 0) && unlang_profile_sample()) {
+			fr_time_t start = fr_time();
+
+			action = unlang_ops[instruction->type].func(request, stack, &result, &priority);
+			unlang_profile_record(instruction, start,
+					      ((action == UNLANG_ACTION_CALCULATE_RESULT) &&
+					       (result == RLM_MODULE_YIELD)));
+		} else {
+			action = unlang_ops[instruction->type].func(request, stack, &result, &priority);
+		}
 
 		RDEBUG4("** [%i] %s << %s (%d)", stack->depth, __FUNCTION__,
 			fr_int2str(unlang_action_table, action, "<INVALID>"), priority);
 
+		if (request->async && request->async->cpu_budget) unlang_cpu_budget_check(request, instruction);
+
 		rad_assert(priority >= -1);
 		rad_assert(priority <= MOD_PRIORITY_MAX);
 
@@ -1353,7 +2214,8 @@ resume_subsection:
 
 		case UNLANG_ACTION_CALCULATE_RESULT:
 			if (result == RLM_MODULE_YIELD) {
-				rad_assert(frame->instruction->type == UNLANG_TYPE_MODULE_RESUME);
+				rad_assert((frame->instruction->type == UNLANG_TYPE_MODULE_RESUME) ||
+					   (frame->instruction->type == UNLANG_TYPE_PARALLEL));
 				frame->resume = true;
 				RDEBUG4("** [%i] %s - yielding with current (%s %d)", stack->depth, __FUNCTION__,
 					fr_int2str(mod_rcode_table, frame->result, "<invalid>"),
@@ -1487,6 +2349,9 @@ done_subsection:
 		RDEBUG4("** [%i] %s - returning %s", stack->depth, __FUNCTION__,
 			fr_int2str(mod_rcode_table, frame->result, "<invalid>"));
 		result = frame->result;
+		if ((frame->trace_span >= 0) && request->async && request->async->trace) {
+			fr_trace_span_end(request->async->trace, frame->trace_span, fr_time());
+		}
 		stack->depth--;
 		DUMP_STACK;
 		return result;
@@ -1598,11 +2463,30 @@ void unlang_push_section(REQUEST *request, CONF_SECTION *cs, rlm_rcode_t action)
 
 	if (!instruction) instruction = unlang_group_to_generic(&empty_group);
 
+	/*
+	 *	Each section a request runs through from the top
+	 *	is subject to the budget of its virtual server.
+	 */
+	if ((stack->depth == 0) && !request->parent) virtual_server_budget_set(request);
+
 	/*
 	 *	Push the default action, and the instruction which has
 	 *	no action.
 	 */
 	unlang_push(stack, NULL, action, UNLANG_NEXT_STOP, UNLANG_TOP_FRAME);
+
+	/*
+	 *	Traced requests get a span for each section, which
+	 *	ends when we return from the top frame.
+	 */
+	if (cs && request->async && request->async->trace) {
+		char name[FR_TRACE_NAME_LEN];
+
+		snprintf(name, sizeof(name), "%s %s", cf_section_name1(cs),
+			 cf_section_name2(cs) ? cf_section_name2(cs) : "");
+		stack->frame[stack->depth].trace_span = fr_trace_span_start(request->async->trace, name, NULL, fr_time());
+	}
+
 	if (instruction) unlang_push(stack, instruction, RLM_MODULE_UNKNOWN, UNLANG_NEXT_CONTINUE, UNLANG_SUB_FRAME);
 
 	RDEBUG4("** [%i] %s - substack begins", stack->depth, __FUNCTION__);
@@ -1733,6 +2617,13 @@ static void unlang_event_timeout_handler(UNUSED fr_event_list_t *el, struct time
 	memcpy(&mutable_ctx, &ev->ctx, sizeof(mutable_ctx));
 	memcpy(&mutable_inst, &ev->inst, sizeof(mutable_inst));
 
+	/*
+	 *	The event is done, so forget about it.  Otherwise
+	 *	a later event with the same ctx would try to free
+	 *	this one again.
+	 */
+	(void) request_data_get(ev->request, ev->ctx, -1);
+
 	ev->timeout(ev->request, mutable_inst, ev->thread, mutable_ctx, now);
 	talloc_free(ev);
 }
@@ -1802,6 +2693,21 @@ static void unlang_event_fd_error_handler(UNUSED fr_event_list_t *el, int fd,
 	ev->fd_error(ev->request, mutable_inst, ev->thread, mutable_ctx, fd);
 }
 
+/** Get the module call a frame is running
+ *
+ * Once a module has yielded, its frame holds a resumption instead, which
+ * wraps the original module call.  A module may yield again from its
+ * resume callback, so we need to handle both.
+ */
+static inline unlang_module_call_t *unlang_frame_module_call(unlang_stack_frame_t *frame)
+{
+	if (frame->instruction->type == UNLANG_TYPE_MODULE_RESUME) {
+		return &unlang_generic_to_module_resumption(frame->instruction)->module;
+	}
+
+	return unlang_generic_to_module_call(frame->instruction);
+}
+
 /** Set a timeout for the request.
  *
  * Used when a module needs wait for an event.  Typically the callback is set, and then the
@@ -1823,14 +2729,12 @@ int unlang_event_timeout_add(REQUEST *request, fr_unlang_timeout_callback_t call
 	unlang_stack_t			*stack = request->stack;
 	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
 	unlang_event_t			*ev;
-	unlang_module_call_t		*sp;
 	unlang_stack_state_modcall_t	*modcall_state = talloc_get_type_abort(frame->state,
 									       unlang_stack_state_modcall_t);
 
 	rad_assert(stack->depth > 0);
 	rad_assert((frame->instruction->type == UNLANG_TYPE_MODULE_CALL) ||
 		   (frame->instruction->type == UNLANG_TYPE_MODULE_RESUME));
-	sp = unlang_generic_to_module_call(frame->instruction);
 
 	ev = talloc_zero(request, unlang_event_t);
 	if (!ev) return -1;
@@ -1838,11 +2742,17 @@ int unlang_event_timeout_add(REQUEST *request, fr_unlang_timeout_callback_t call
 	ev->request = request;
 	ev->fd = -1;
 	ev->timeout = callback;
-	ev->inst = sp->module_instance->dl_inst->data;
+	ev->inst = modcall_state->inst;
 	ev->thread = modcall_state->thread;
 	ev->ctx = ctx;
 
-	if (fr_event_timer_insert(request, request->el, &ev->ev,
+	/*
+	 *	Bind the timer to the unlang_event_t, and not to the
+	 *	request.  Otherwise freeing the request can free the
+	 *	timer first, and leave ev->ev dangling for
+	 *	_unlang_event_free().
+	 */
+	if (fr_event_timer_insert(ev, request->el, &ev->ev,
 				  when, unlang_event_timeout_handler, ev) < 0) {
 		RPEDEBUG("Failed inserting event");
 		talloc_free(ev);
@@ -1905,7 +2815,6 @@ int unlang_event_fd_add(REQUEST *request,
 	unlang_stack_t			*stack = request->stack;
 	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
 	unlang_event_t			*ev;
-	unlang_module_call_t		*sp;
 	unlang_stack_state_modcall_t	*modcall_state = talloc_get_type_abort(frame->state,
 									       unlang_stack_state_modcall_t);
 
@@ -1913,7 +2822,6 @@ int unlang_event_fd_add(REQUEST *request,
 
 	rad_assert((frame->instruction->type == UNLANG_TYPE_MODULE_CALL) ||
 		   (frame->instruction->type == UNLANG_TYPE_MODULE_RESUME));
-	sp = unlang_generic_to_module_call(frame->instruction);
 
 	ev = talloc_zero(request, unlang_event_t);
 	if (!ev) return -1;
@@ -1923,7 +2831,7 @@ int unlang_event_fd_add(REQUEST *request,
 	ev->fd_read = read;
 	ev->fd_write = write;
 	ev->fd_error = error;
-	ev->inst = sp->module_instance->dl_inst->data;
+	ev->inst = modcall_state->inst;
 	ev->thread = modcall_state->thread;
 	ev->ctx = ctx;
 
@@ -1976,7 +2884,41 @@ int unlang_event_fd_delete(REQUEST *request, void const *ctx, int fd)
  */
 void unlang_resumable(REQUEST *request)
 {
+	REQUEST			*parent = request->parent;
+	unlang_stack_t		*stack;
+	unlang_stack_frame_t	*frame;
+	unlang_parallel_t	*state;
+
 	fr_heap_insert(request->backlog, request);
+
+	/*
+	 *	Children of a "parallel" section, and children
+	 *	being run by a module with rad_virtual_server_child(),
+	 *	are runnable from the parent's point of view.  It's
+	 *	the parent which needs to be scheduled, so that it
+	 *	can resume them.
+	 */
+	if (!parent || (parent->heap_id >= 0) || !parent->backlog) return;
+	if (request->backlog == parent->backlog) return;
+
+	stack = parent->stack;
+	frame = &stack->frame[stack->depth];
+	switch (frame->instruction->type) {
+	case UNLANG_TYPE_PARALLEL:
+		if (!frame->state) return;
+
+		state = talloc_get_type_abort(frame->state, unlang_parallel_t);
+		if (state->runnable != request->backlog) return;
+		break;
+
+	case UNLANG_TYPE_MODULE_RESUME:
+		break;
+
+	default:
+		return;
+	}
+
+	unlang_resumable(parent);
 }
 
 /** Send a signal (usually stop) to a request
@@ -1994,12 +2936,18 @@ void unlang_signal(REQUEST *request, fr_state_action_t action)
 	unlang_stack_frame_t		*frame;
 	unlang_stack_t			*stack = request->stack;
 	unlang_module_resumption_t	*mr;
+	unlang_stack_state_modcall_t	*modcall_state;
 	void				*mutable;
 
 	rad_assert(stack->depth > 0);
 
 	frame = &stack->frame[stack->depth];
 
+	if (frame->instruction->type == UNLANG_TYPE_PARALLEL) {
+		unlang_parallel_signal(frame, action);
+		return;
+	}
+
 	rad_assert(frame->instruction->type == UNLANG_TYPE_MODULE_RESUME);
 
 	mr = unlang_generic_to_module_resumption(frame->instruction);
@@ -2007,7 +2955,9 @@ void unlang_signal(REQUEST *request, fr_state_action_t action)
 
 	memcpy(&mutable, &mr->ctx, sizeof(mutable));
 
-	mr->signal_callback(request, mr->module.module_instance->dl_inst->data, mr->thread, mutable, action);
+	modcall_state = talloc_get_type_abort(frame->state, unlang_stack_state_modcall_t);
+
+	mr->signal_callback(request, modcall_state->inst, mr->thread, mutable, action);
 }
 
 /** Yield a request back to the interpreter from within a module
@@ -2040,7 +2990,7 @@ rlm_rcode_t unlang_module_yield(REQUEST *request, fr_unlang_module_resume_t call
 
 	rad_assert((frame->instruction->type == UNLANG_TYPE_MODULE_CALL) ||
 		   (frame->instruction->type == UNLANG_TYPE_MODULE_RESUME));
-	sp = unlang_generic_to_module_call(frame->instruction);
+	sp = unlang_frame_module_call(frame);
 
 	mr = talloc(request, unlang_module_resumption_t);
 	rad_assert(mr != NULL);
@@ -66,6 +66,25 @@ typedef struct {
  */
 static fr_virtual_server_t **virtual_servers;
 
+/** Limits on the resources a request in a virtual server may use
+ *
+ * Stored as CONF_DATA on the server section.
+ */
+typedef struct {
+	struct timeval		cpu;		//!< CPU time a request may use.
+	struct timeval		time;		//!< Time a request may take, from when it was received.
+
+	fr_time_t		cpu_budget;	//!< cpu, or 0 for no limit.
+	fr_time_t		time_budget;	//!< time, or 0 for no limit.
+} fr_virtual_server_budget_t;
+
+static const CONF_PARSER budget_config[] = {
+	{ FR_CONF_OFFSET("cpu", FR_TYPE_TIMEVAL, fr_virtual_server_budget_t, cpu) },
+	{ FR_CONF_OFFSET("time", FR_TYPE_TIMEVAL, fr_virtual_server_budget_t, time) },
+
+	CONF_PARSER_TERMINATOR
+};
+
 static int listen_parse(TALLOC_CTX *ctx, void *out, CONF_ITEM *ci, CONF_PARSER const *rule);
 static const CONF_PARSER server_config[] = {
 	{ FR_CONF_OFFSET("namespace", FR_TYPE_STRING, fr_virtual_server_t, namespace) },
@@ -411,6 +430,50 @@ int virtual_servers_instantiate(UNUSED CONF_SECTION *config)
 	return 0;
 }
 
+/** Parse the "budget" section of a virtual server
+ *
+ * @param[in] server_cs	the virtual server.
+ * @return
+ *	- 0 on success, or if there's no "budget" section.
+ *	- -1 on failure.
+ */
+static int virtual_server_budget_parse(CONF_SECTION *server_cs)
+{
+	CONF_SECTION			*cs;
+	fr_virtual_server_budget_t	*budget;
+
+	cs = cf_section_find(server_cs, "budget", NULL);
+	if (!cs) return 0;
+
+	MEM(budget = talloc_zero(server_cs, fr_virtual_server_budget_t));
+
+	if ((cf_section_rules_push(cs, budget_config) < 0) || (cf_section_parse(budget, budget, cs) < 0)) {
+		cf_log_err(cs, "Failed parsing budget section");
+		talloc_free(budget);
+		return -1;
+	}
+
+	if (fr_timeval_isset(&budget->cpu)) {
+		FR_TIMEVAL_BOUND_CHECK("cpu", &budget->cpu, >=, 0, 1000);
+		FR_TIMEVAL_BOUND_CHECK("cpu", &budget->cpu, <=, 60, 0);
+	}
+
+	if (fr_timeval_isset(&budget->time)) {
+		FR_TIMEVAL_BOUND_CHECK("time", &budget->time, >=, 0, 10000);
+		FR_TIMEVAL_BOUND_CHECK("time", &budget->time, <=, 120, 0);
+	}
+
+	budget->cpu_budget = (((fr_time_t) budget->cpu.tv_sec) * NANOSEC) + (((fr_time_t) budget->cpu.tv_usec) * 1000);
+	budget->time_budget = (((fr_time_t) budget->time.tv_sec) * NANOSEC) + (((fr_time_t) budget->time.tv_usec) * 1000);
+
+	if (!cf_data_add(server_cs, budget, NULL, false)) {
+		talloc_free(budget);
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Load protocol modules and call their bootstrap methods
  *
  * @return
@@ -450,6 +513,8 @@ int virtual_servers_bootstrap(CONF_SECTION *config)
 		if (!cf_pair_find(cs, "namespace")) {
 			WARN("Skipping old-style server %s", cf_section_name2(cs));
 		}
+
+		if (virtual_server_budget_parse(cs) < 0) return -1;
 	}
 
 	for (i = 0; i < server_cnt; i++) {
@@ -481,6 +546,33 @@ int virtual_servers_bootstrap(CONF_SECTION *config)
 	return 0;
 }
 
+/** Apply the budget of the request's virtual server
+ *
+ * The CPU budget is enforced by the interpreter, between instructions.
+ * The time budget brings the request's deadline forward, and the
+ * worker stops requests which are past their deadline, even while
+ * they're waiting for a module.
+ *
+ * @param[in] request	to apply the budget to.
+ */
+void virtual_server_budget_set(REQUEST *request)
+{
+	fr_virtual_server_budget_t const	*budget;
+	fr_time_t				deadline;
+
+	if (!request->async || !request->server_cs) return;
+
+	budget = cf_data_value(cf_data_find(request->server_cs, fr_virtual_server_budget_t, NULL));
+	if (!budget) return;
+
+	request->async->cpu_budget = budget->cpu_budget;
+
+	if (!budget->time_budget) return;
+
+	deadline = request->async->recv_time + budget->time_budget;
+	if (!request->async->deadline || (deadline < request->async->deadline)) request->async->deadline = deadline;
+}
+
 /** Return virtual server matching the specified name
  *
  * @note May be called in bootstrap or instantiate as all servers should be present.
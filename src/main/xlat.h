@@ -42,6 +42,7 @@ typedef struct xlat_t {
 	size_t			inst_size;		//!< Length of instance data to pre-allocate.
 	size_t			buf_len;		//!< Length of output buffer to pre-allocate.
 	bool			internal;		//!< If true, cannot be redefined.
+	bool			pure;			//!< Output depends only on the input, so may be memoised.
 } xlat_t;
 
 typedef enum {
@@ -73,6 +74,8 @@ struct xlat_exp {
 		int		regex_index;	//!< for %{1} and friends.
 	};
 	xlat_t const	*xlat;		//!< The xlat expansion to expand format with.
+	void		*inst;		//!< Instance data created by the xlat's instantiation function,
+					//!< if the argument was fixed when the xlat was tokenized.
 };
 
 typedef struct xlat_out {
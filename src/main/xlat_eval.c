@@ -315,6 +315,76 @@ finish:
 	return ret;
 }
 
+/*
+ *	Memoised expansions of pure xlat functions.
+ */
+#define REQUEST_DATA_XLAT_MEMO	(0xadbeef01)
+#define XLAT_MEMO_MAX		(64)	//!< Per request, so loops can't grow it forever.
+
+typedef struct xlat_memo_t {
+	xlat_t const	*xlat;		//!< Function which was called.
+	char const	*in;		//!< Input it was called with.
+	char const	*out;		//!< What it returned.
+} xlat_memo_t;
+
+static int xlat_memo_cmp(void const *one, void const *two)
+{
+	xlat_memo_t const *a = one, *b = two;
+
+	if (a->xlat != b->xlat) return (a->xlat < b->xlat) - (a->xlat > b->xlat);
+
+	return strcmp(a->in, b->in);
+}
+
+/** Find a previous expansion of a pure xlat function with the same input
+ *
+ * @return a copy of the output allocated in ctx, or NULL if there isn't one.
+ */
+static char *xlat_memo_find(TALLOC_CTX *ctx, REQUEST *request, xlat_t const *xlat, char const *in)
+{
+	rbtree_t	*memo;
+	xlat_memo_t	my_memo, *found;
+
+	memo = request_data_reference(request, request, REQUEST_DATA_XLAT_MEMO);
+	if (!memo) return NULL;
+
+	my_memo.xlat = xlat;
+	my_memo.in = in;
+	found = rbtree_finddata(memo, &my_memo);
+	if (!found) return NULL;
+
+	return talloc_typed_strdup(ctx, found->out);
+}
+
+/** Record the expansion of a pure xlat function
+ */
+static void xlat_memo_add(REQUEST *request, xlat_t const *xlat, char const *in, char const *out)
+{
+	rbtree_t	*memo;
+	xlat_memo_t	*entry;
+
+	memo = request_data_reference(request, request, REQUEST_DATA_XLAT_MEMO);
+	if (!memo) {
+		memo = rbtree_create(request, xlat_memo_cmp, NULL, 0);
+		if (!memo) return;
+
+		if (request_data_add(request, request, REQUEST_DATA_XLAT_MEMO, memo, true, false, false) < 0) {
+			talloc_free(memo);
+			return;
+		}
+	}
+
+	if (rbtree_num_elements(memo) >= XLAT_MEMO_MAX) return;
+
+	entry = talloc(memo, xlat_memo_t);
+	if (!entry) return;
+
+	entry->xlat = xlat;
+	entry->in = talloc_typed_strdup(entry, in);
+	entry->out = talloc_typed_strdup(entry, out);
+	if (!entry->in || !entry->out || !rbtree_insert(memo, entry)) talloc_free(entry);
+}
+
 #ifdef DEBUG_XLAT
 static const char xlat_spaces[] = "                                                                                                                                                                                                                                                                ";
 #endif
@@ -547,16 +617,32 @@ static char *xlat_aprint(TALLOC_CTX *ctx, REQUEST *request, xlat_exp_t const * c
 			*q = '\0';
 		}
 
+		/*
+		 *	Pure functions called with the same input
+		 *	will return the same output.
+		 */
+		if (node->xlat->pure) {
+			str = xlat_memo_find(ctx, request, node->xlat, child);
+			if (str) {
+				XLAT_DEBUG("%.*sMEMOISED mod %s", lvl, xlat_spaces, node->fmt);
+				talloc_free(child);
+				break;
+			}
+		}
+
 		if (node->xlat->buf_len > 0) {
 			str = talloc_array(ctx, char, node->xlat->buf_len);
 			str[0] = '\0';	/* Be sure the string is \0 terminated */
 		}
-		rcode = node->xlat->func(ctx, &str, node->xlat->buf_len, node->xlat->mod_inst, NULL, request, child);
-		talloc_free(child);
+		rcode = node->xlat->func(ctx, &str, node->xlat->buf_len, node->xlat->mod_inst, node->inst,
+					 request, child);
 		if (rcode < 0) {
+			talloc_free(child);
 			talloc_free(str);
 			return NULL;
 		}
+		if (node->xlat->pure && str) xlat_memo_add(request, node->xlat, child, str);
+		talloc_free(child);
 		break;
 
 #ifdef HAVE_REGEX
@@ -836,3 +922,40 @@ ssize_t xlat_aeval_compiled(TALLOC_CTX *ctx, char **out, REQUEST *request,
 	*out = NULL;
 	return _xlat_eval_compiled(ctx, out, 0, request, xlat, escape, escape_ctx);
 }
+
+/** Get the value of a compiled xlat expansion, without printing it to a string
+ *
+ * If the expansion is a single attribute reference e.g. "%{Framed-IP-Address}",
+ * and the attribute is of the requested type, then the value of the attribute
+ * is copied directly.  This avoids printing the value to a string, only for
+ * the caller to parse it back into the same type.
+ *
+ * Anything more complex (literals, functions, virtual attributes, [*] and [#],
+ * or values which would need casting) is left to #xlat_aeval_compiled.
+ *
+ * @param[in] ctx		to allocate any buffers in.
+ * @param[out] out		Where to write the value.
+ * @param[in] request		current request.
+ * @param[in] node		the xlat structure to expand.
+ * @param[in] type		the value must be of.
+ * @return
+ *	- 1 if out contains the value of the referenced attribute.
+ *	- 0 if the expansion should be done with #xlat_aeval_compiled.
+ *	- -1 on error.
+ */
+int xlat_eval_compiled_box(TALLOC_CTX *ctx, fr_value_box_t *out, REQUEST *request,
+			   xlat_exp_t const *node, fr_type_t type)
+{
+	VALUE_PAIR *vp;
+
+	if ((node->type != XLAT_ATTRIBUTE) || node->next) return 0;
+
+	if ((node->attr->type != TMPL_TYPE_ATTR) ||
+	    (node->attr->tmpl_num == NUM_ALL) || (node->attr->tmpl_num == NUM_COUNT)) return 0;
+
+	if ((tmpl_find_vp(&vp, request, node->attr) < 0) || (vp->vp_type != type)) return 0;
+
+	if (fr_value_box_copy(ctx, out, &vp->data) < 0) return -1;
+
+	return 1;
+}
@@ -775,6 +775,7 @@ int xlat_register(void *mod_inst, char const *name,
 		c->mod_inst = mod_inst;
 		c->instantiate = instantiate;
 		c->inst_size = inst_size;
+		c->pure = false;
 		return 0;
 	}
 
@@ -798,6 +799,33 @@ int xlat_register(void *mod_inst, char const *name,
 	return 0;
 }
 
+/** Register an xlat function whose output depends only on its input
+ *
+ * The expansions of pure functions are memoised for the lifetime of the
+ * request, so the same function with the same (expanded) input is only
+ * called once, no matter how many modules or policies use it.
+ *
+ * A function must not be registered as pure if it looks up attributes,
+ * or otherwise uses anything other than the string it's passed.
+ *
+ * @copydetails xlat_register
+ */
+int xlat_register_pure(void *mod_inst, char const *name,
+		       xlat_func_t func, xlat_escape_t escape,
+		       xlat_instantiate_t instantiate, size_t inst_size,
+		       size_t buf_len)
+{
+	xlat_t	*c;
+
+	if (xlat_register(mod_inst, name, func, escape, instantiate, inst_size, buf_len) < 0) return -1;
+
+	c = xlat_find(name);
+	rad_assert(c != NULL);
+	c->pure = true;
+
+	return 0;
+}
+
 /** Unregister an xlat function
  *
  * We can only have one function to call per name, so the passing of "func"
@@ -165,6 +165,54 @@ static ssize_t xlat_tokenize_alternation(TALLOC_CTX *ctx, char *fmt, xlat_exp_t
 	return p - fmt;
 }
 
+/** Call the instantiation function of a module xlat
+ *
+ * This is only done if the argument is fixed, i.e. only literal text,
+ * so that the xlat can pre-parse it.  Otherwise the argument is only
+ * known at run-time, and node->inst is left NULL.
+ *
+ * @param[in] node	to instantiate.
+ * @param[out] error	where to write a pointer to an error message.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the instantiation function failed.
+ */
+static int xlat_instantiate_node(xlat_exp_t *node, char const **error)
+{
+	xlat_exp_t	*child;
+	char		*arg;
+	int		ret;
+
+	if (!node->xlat->instantiate) return 0;
+
+	/*
+	 *	Escape sequences are processed at run-time, so
+	 *	treat them as if they were expansions.
+	 */
+	for (child = node->child; child; child = child->next) {
+		if ((child->type != XLAT_LITERAL) || strchr(child->fmt, '\\')) return 0;
+	}
+
+	/*
+	 *	"%%" is a separate literal node, so join them all.
+	 */
+	arg = talloc_typed_strdup(node, "");
+	for (child = node->child; child; child = child->next) {
+		arg = talloc_strdup_append_buffer(arg, child->fmt);
+	}
+
+	node->inst = talloc_zero_array(node, uint8_t, node->xlat->inst_size);
+	ret = node->xlat->instantiate(node->inst, node->xlat->mod_inst, arg);
+	talloc_free(arg);
+	if (ret < 0) {
+		TALLOC_FREE(node->inst);
+		*error = fr_strerror();
+		return -1;
+	}
+
+	return 0;
+}
+
 static ssize_t xlat_tokenize_expansion(TALLOC_CTX *ctx, char *fmt, xlat_exp_t **head,
 				       char const **error)
 {
@@ -271,6 +319,11 @@ static ssize_t xlat_tokenize_expansion(TALLOC_CTX *ctx, char *fmt, xlat_exp_t **
 			}
 			p += slen;
 
+			if (xlat_instantiate_node(node, error) < 0) {
+				talloc_free(node);
+				return -((q + 1) - fmt);
+			}
+
 			*head = node;
 			rad_assert(node->next == NULL);
 
@@ -1,12 +1 @@
-TARGETNAME	:= proto_arp
-
-#
-#  ARP depends on pcap.
-#
-ifneq "$(PCAP_LIBS)" ""
-TARGET		:= $(TARGETNAME).a
-endif
-
-SOURCES		:= proto_arp.c
-TGT_PREREQS	:= libfreeradius-util.a
-TGT_LDLIBS	:= $(PCAP_LIBS)
+SUBMAKEFILES := proto_arp.mk proto_arp_base.mk proto_arp_ethernet.mk
@@ -1,8 +1,4 @@
 /*
- * arp.c	ARP processing.
- *
- * Version:	$Id$
- *
  *   This program is free software; you can redistribute it and/or modify
  *   it under the terms of the GNU General Public License as published by
  *   the Free Software Foundation; either version 2 of the License, or
@@ -16,309 +12,428 @@
  *   You should have received a copy of the GNU General Public License
  *   along with this program; if not, write to the Free Software
  *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
- *
- * Copyright (C) 2013 Network RADIUS SARL <info@networkradius.com>
  */
 
+/**
+ * $Id$
+ * @file proto_arp.c
+ * @brief ARP master protocol handler.
+ *
+ * @copyright 2013,2017 The FreeRADIUS server project.
+ * @copyright 2013 Network RADIUS SARL <info@networkradius.com>
+ */
 #include <freeradius-devel/radiusd.h>
-#include <freeradius-devel/protocol.h>
-#include <freeradius-devel/modules.h>
-#include <freeradius-devel/process.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/io/application.h>
 #include <freeradius-devel/rad_assert.h>
-#include <freeradius-devel/pcap.h>
 #include <net/if_arp.h>
+#include "proto_arp.h"
 
-typedef struct arp_socket_t {
-	listen_socket_t	lsock;
-	uint64_t	counter;
-	RADCLIENT	client;
-} arp_socket_t;
+extern fr_app_t proto_arp;
+static int transport_parse(TALLOC_CTX *ctx, void *out, CONF_ITEM *ci, CONF_PARSER const *rule);
 
-/*
- *	ARP for ethernet && IPv4.
+/** How to parse an ARP listen section
+ *
  */
-typedef struct arp_over_ether {
-	uint16_t	htype;			//!< Format of hardware address.
-	uint16_t	ptype;			//!< Format of protocol address.
-	uint8_t		hlen;			//!< Length of hardware address.
-	uint8_t		plen;			//!< Length of protocol address.
-	uint8_t		op;			//!< 1 - Request, 2 - Reply.
-	uint8_t		sha[ETHER_ADDR_LEN];	//!< sender hardware address.
-	uint8_t		spa[4];			//!< Sender protocol address.
-	uint8_t		tha[ETHER_ADDR_LEN];	//!< Target hardware address.
-	uint8_t		tpa[4];			//!< Target protocol address.
-} arp_over_ether_t;
-
-static rlm_rcode_t arp_process(REQUEST *request)
-{
-	CONF_SECTION *unlang;
+static CONF_PARSER const proto_arp_config[] = {
+	{ FR_CONF_OFFSET("type", FR_TYPE_STRING | FR_TYPE_MULTI, proto_arp_t, types) },
+	{ FR_CONF_OFFSET("transport", FR_TYPE_VOID, proto_arp_t, io_submodule),
+	  .func = transport_parse },
 
-	request->server_cs = request->listener->server_cs;
-	unlang = cf_section_find(request->server_cs, "arp", NULL);
+	/*
+	 *	For performance tweaking.  NOT for normal humans.
+	 */
+	{ FR_CONF_OFFSET("default_message_size", FR_TYPE_UINT32, proto_arp_t, default_message_size) } ,
+	{ FR_CONF_OFFSET("num_messages", FR_TYPE_UINT32, proto_arp_t, num_messages) } ,
 
-	request->component = "arp";
+	CONF_PARSER_TERMINATOR
+};
 
-	return unlang_interpret(request, unlang, RLM_MODULE_NOOP);
-}
+typedef struct arp_decode_t {
+	char const	*name;
+	size_t		len;
+} arp_decode_t;
+
+static const arp_decode_t header_names[] = {
+	{ "ARP-Hardware-Format",		2 },
+	{ "ARP-Protocol-Format",		2 },
+	{ "ARP-Hardware-Address-Length",	1 },
+	{ "ARP-Protocol-Address-Length",	1 },
+	{ "ARP-Operation",			2 },
+	{ "ARP-Sender-Hardware-Address",	6 },
+	{ "ARP-Sender-Protocol-Address",	4 },
+	{ "ARP-Target-Hardware-Address",	6 },
+	{ "ARP-Target-Protocol-Address",	4 },
 
+	{ NULL, 0 }
+};
 
 /*
- *	Check if an incoming request is "ok"
+ *	Looked up once, when the module is loaded.
+ */
+static fr_dict_attr_t const *header_attrs[sizeof(header_names) / sizeof(header_names[0])];
+
+/** Wrapper around dl_instance
  *
- *	It takes packets, not requests.  It sees if the packet looks
- *	OK.  If so, it does a number of sanity checks on it.
+ * @param[in] ctx	to allocate data in (instance of proto_arp).
+ * @param[out] out	Where to write a dl_instance_t containing the module handle and instance.
+ * @param[in] ci	#CONF_PAIR specifying the name of the type module.
+ * @param[in] rule	unused.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static int arp_socket_recv(rad_listen_t *listener)
+static int transport_parse(TALLOC_CTX *ctx, void *out, CONF_ITEM *ci, UNUSED CONF_PARSER const *rule)
 {
-	int ret;
-	arp_socket_t *sock = listener->data;
-	pcap_t *handle = sock->lsock.pcap->handle;
+	char const	*name = cf_pair_value(cf_item_to_pair(ci));
+	dl_instance_t	*parent_inst;
+	CONF_SECTION	*listen_cs = cf_item_to_section(cf_parent(ci));
+	CONF_SECTION	*transport_cs;
 
-	const uint8_t *data;
-	struct pcap_pkthdr *header;
-	ssize_t link_len;
+	transport_cs = cf_section_find(listen_cs, name, NULL);
 
-	arp_over_ether_t const *arp;
-	RADIUS_PACKET *packet;
+	/*
+	 *	Allocate an empty section if one doesn't exist
+	 *	this is so defaults get parsed.
+	 */
+	if (!transport_cs) transport_cs = cf_section_alloc(listen_cs, listen_cs, name, NULL);
 
-	ret = pcap_next_ex(handle, &header, &data);
-	if (ret == 0) {
-		DEBUG("No packet retrieved from pcap.");
-		return 0; /* no packet */
-	}
+	parent_inst = cf_data_value(cf_data_find(listen_cs, dl_instance_t, "proto_arp"));
+	rad_assert(parent_inst);
 
-	if (ret < 0) {
-		ERROR("Error requesting next packet, got (%i): %s", ret, pcap_geterr(handle));
-		return 0;
-	}
+	return dl_instance(ctx, out, transport_cs, parent_inst, name, DL_TYPE_SUBMODULE);
+}
 
-	link_len = fr_link_layer_offset(data, header->caplen, sock->lsock.pcap->link_layer);
-	if (link_len < 0) {
-		PERROR("Failed determining link layer header offset");
-		return 0;
+/** Decode the packet.
+ *
+ *  The transport has already checked that this is ARP for Ethernet
+ *  and IPv4, with an ARP-Operation we listen for.
+ */
+static int mod_decode(void const *instance, REQUEST *request, uint8_t *const data, size_t data_len)
+{
+	proto_arp_t const		*inst = talloc_get_type_abort(instance, proto_arp_t);
+	RADIUS_PACKET			*packet = request->packet;
+	arp_over_ether_t const		*arp;
+	uint8_t const			*p, *end;
+	fr_cursor_t			cursor;
+	int				i;
+
+	if (inst->app_io->decode(inst->app_io_instance, request, data, data_len) < 0) return -1;
+
+	if (packet->data_len < sizeof(*arp)) {
+		RDEBUG("Packet too small, we require at least %zu bytes, got %zu bytes",
+		       sizeof(*arp), packet->data_len);
+		return -1;
 	}
 
 	/*
-	 *	Silently ignore it if it's too small to be ARP.
-	 *
-	 *	This can happen when pcap gets overloaded and starts truncating packets.
+	 *	The worker holds the message until it's done with the
+	 *	request, so we can decode straight out of it.
 	 */
-	if (header->caplen < (link_len + sizeof(*arp))) {
-		ERROR("Packet too small, we require at least %zu bytes, got %i bytes",
-		      link_len + sizeof(*arp), header->caplen);
-		return 0;
+	if (!request->async->message) {
+		packet->data = talloc_memdup(packet, packet->data, packet->data_len);
+		if (!packet->data) return -1;
 	}
 
-	data += link_len;
-	arp = (arp_over_ether_t const *) data;
+	arp = (arp_over_ether_t const *) packet->data;
 
-	if (ntohs(arp->htype) != ARPHRD_ETHER) return 0;
+	packet->code = ntohs(arp->op);
+	packet->id = -1;
 
-	if (ntohs(arp->ptype) != 0x0800) return 0;
+	packet->src_ipaddr.af = AF_INET;
+	packet->src_ipaddr.prefix = 32;
+	memcpy(&packet->src_ipaddr.addr.v4.s_addr, arp->spa, sizeof(arp->spa));
 
-	if (arp->hlen != ETHER_ADDR_LEN) return 0; /* FIXME: malformed error */
+	packet->dst_ipaddr.af = AF_INET;
+	packet->dst_ipaddr.prefix = 32;
+	memcpy(&packet->dst_ipaddr.addr.v4.s_addr, arp->tpa, sizeof(arp->tpa));
 
-	if (arp->plen != 4) return 0; /* FIXME: malformed packet error */
+	p = packet->data;
+	end = p + sizeof(*arp);
 
-	packet = talloc_zero(NULL, RADIUS_PACKET);
-	if (!packet) return 0;
+	fr_cursor_init(&cursor, &packet->vps);
 
-	packet->dst_port = 1;	/* so it's not a "fake" request */
-	packet->data_len = header->caplen - link_len;
-	packet->data = talloc_memdup(packet, arp, packet->data_len);
-	talloc_set_type(packet->data, uint8_t);
+	for (i = 0; header_names[i].name != NULL; i++) {
+		ssize_t			ret;
+		size_t			len;
+		VALUE_PAIR		*vp = NULL;
 
-	DEBUG("ARP received on interface %s", sock->lsock.interface);
+		len = header_names[i].len;
 
-	if (!request_receive(NULL, listener, packet, &sock->client, arp_process)) {
-		fr_radius_free(&packet);
-		return 0;
-	}
+		if (!rad_cond_assert((size_t)(end - p) >= len)) return -1; /* Checked above */
 
-	return 1;
-}
+		MEM(vp = fr_pair_afrom_da(packet, header_attrs[i]));
+		ret = fr_value_box_from_network(vp, &vp->data, vp->da->type, vp->da, p, len, true);
+		if (ret <= 0) {
+			fr_pair_to_unknown(vp);
+			fr_pair_value_memcpy(vp, p, len);
+		}
 
-static int arp_socket_send(UNUSED rad_listen_t *listener, UNUSED REQUEST *request)
-{
-	return 0;
-}
+		fr_cursor_insert(&cursor, vp);
+		p += len;
+	}
 
+	request->root = &main_config;
 
-static int arp_socket_encode(UNUSED rad_listen_t *listener, UNUSED REQUEST *request)
-{
 	return 0;
 }
 
+static void mod_process_set(void const *instance, REQUEST *request)
+{
+	proto_arp_t const *inst = talloc_get_type_abort(instance, proto_arp_t);
+	fr_io_process_t process;
 
-typedef struct arp_decode_t {
-	char const	*name;
-	size_t		len;
-} arp_decode_t;
+	request->server_cs = inst->server_cs;
 
-static const arp_decode_t header_names[] = {
-	{ "ARP-Hardware-Format",		2 },
-	{ "ARP-Protocol-Format",		2 },
-	{ "ARP-Hardware-Address-Length",	1 },
-	{ "ARP-Protocol-Address-Length",	1 },
-	{ "ARP-Operation",			2 },
-	{ "ARP-Sender-Hardware-Address",	6 },
-	{ "ARP-Sender-Protocol-Address",	4 },
-	{ "ARP-Target-Hardware-Address",	6 },
-	{ "ARP-Target-Protocol-Address",	4 },
+	process = inst->process;
+	if (!process) {
+		REDEBUG("No module available to handle packet type %i", request->packet->code);
+		return;
+	}
 
-	{ NULL, 0 }
-};
+	request->async->process = process;
+}
 
-static int arp_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
+/** Open listen sockets/connect to external event source
+ *
+ * @param[in] instance	Ctx data for this application.
+ * @param[in] sc	to add our file descriptor to.
+ * @param[in] conf	Listen section parsed to give us isntance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_open(void *instance, fr_schedule_t *sc, CONF_SECTION *conf)
 {
-	int			i;
-	uint8_t	const		*p = request->packet->data, *end = p + request->packet->data_len;
-	fr_cursor_t		cursor;
+	fr_listen_t	*listen;
+	proto_arp_t 	*inst = talloc_get_type_abort(instance, proto_arp_t);
 
-	fr_cursor_init(&cursor, &request->packet->vps);
+	/*
+	 *	Build the #fr_listen_t.  This describes the complete
+	 *	path, data takes from the socket to the decoder and
+	 *	back again.
+	 */
+	listen = talloc_zero(inst, fr_listen_t);
 
-	for (i = 0; header_names[i].name != NULL; i++) {
-		ssize_t			ret;
-		size_t			len;
-		fr_dict_attr_t const	*da;
-		VALUE_PAIR		*vp = NULL;
+	listen->app_io = inst->app_io;
+	listen->app_io_instance = inst->app_io_instance;
 
-		len = header_names[i].len;
+	listen->app = &proto_arp;
+	listen->app_instance = instance;
+	listen->server_cs = inst->server_cs;
 
-		if (!rad_cond_assert((size_t)(end - p) < len)) return -1; /* Should have been detected in socket_recv */
+	/*
+	 *	Set configurable parameters for message ring buffer.
+	 */
+	listen->default_message_size = inst->default_message_size;
+	listen->num_messages = inst->num_messages;
 
-		da = fr_dict_attr_by_name(NULL, header_names[i].name);
-		if (!da) return 0;
+	/*
+	 *	Open the socket, and add it to the scheduler.
+	 */
+	if (inst->app_io) {
+		CONF_PAIR *cp = inst->app_io_conf ? cf_pair_find(inst->app_io_conf, "interface") : NULL;
+
+		/*
+		 *	Name the listener for the metrics.
+		 */
+		if (cp && cf_pair_value(cp)) {
+			listen->name = talloc_typed_asprintf(listen, "%s/%s/%s", cf_section_name2(inst->server_cs),
+							     inst->app_io->name, cf_pair_value(cp));
+		} else {
+			listen->name = talloc_typed_asprintf(listen, "%s/%s", cf_section_name2(inst->server_cs),
+							     inst->app_io->name);
+		}
 
-		MEM(vp = fr_pair_afrom_da(request->packet, da));
-		ret = fr_value_box_from_network(vp, &vp->data, da->type, da, p, len, true);
-		if (ret <= 0) {
-			fr_pair_to_unknown(vp);
-			fr_pair_value_memcpy(vp, p, len);
+		if (inst->app_io->open(inst->app_io_instance) < 0) {
+			cf_log_err(conf, "Failed opening %s interface", inst->app_io->name);
+			talloc_free(listen);
+			return -1;
 		}
 
-		debug_pair(vp);
-		fr_cursor_insert(&cursor, vp);
+		if (!fr_schedule_socket_add(sc, listen)) {
+			talloc_free(listen);
+			return -1;
+		}
 	}
 
+	inst->listen = listen;	/* Probably won't need it, but doesn't hurt */
+
 	return 0;
 }
 
-/** Build PCAP filter string to pass to libpcap
- * Will be called by init_pcap.
+/** Instantiate the application
+ *
+ * Instantiate I/O and type submodules.
  *
- * @param this listen section (not used)
- * @return PCAP filter string
+ * @param[in] instance	Ctx data for this application.
+ * @param[in] conf	Listen section parsed to give us isntance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static const char * arp_pcap_filter_builder(UNUSED rad_listen_t *this)
-{
-	return "arp";
-}
-
-static int arp_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
-	int rcode;
-	arp_socket_t	*sock = this->data;
-	RADCLIENT	*client;
-	CONF_PAIR	*cp = NULL;
-
-	sock->lsock.pcap_filter_builder = arp_pcap_filter_builder;
-	sock->lsock.pcap_type = PCAP_INTERFACE_IN;
-
-	this->nodup = true;	/* don't check for duplicates */
+	proto_arp_t		*inst = talloc_get_type_abort(instance, proto_arp_t);
+	fr_app_process_t const	*app_process;
 
-	/* Add ipaddress to conf section as it is not required by ARP config */
-	cp = cf_pair_alloc(cs, "ipv4addr", "0.0.0.0", T_OP_SET, T_BARE_WORD, T_BARE_WORD);
-	cf_pair_add(cs, cp);
+	/*
+	 *	The listener is inside of a virtual server.
+	 */
+	inst->server_cs = cf_item_to_section(cf_parent(conf));
 
-	rcode = common_socket_parse(cs, this);
-	if (rcode != 0) return rcode;
+	/*
+	 *	Instantiate the I/O module
+	 */
+	if (inst->app_io && inst->app_io->instantiate &&
+	    (inst->app_io->instantiate(inst->app_io_instance,
+				       inst->app_io_conf) < 0)) {
+		cf_log_err(conf, "Instantiation failed for \"%s\"", inst->app_io->name);
+		return -1;
+	}
 
-	if (!sock->lsock.interface) {
-		cf_log_err(cs, "'interface' is required for arp");
+	/*
+	 *	Instantiate the process module
+	 */
+	app_process = (fr_app_process_t const *)inst->process_submodule->module->common;
+	if (app_process->instantiate && (app_process->instantiate(inst->process_submodule->data,
+								  inst->process_submodule->conf) < 0)) {
+		cf_log_err(conf, "Instantiation failed for \"%s\"", app_process->name);
 		return -1;
 	}
 
+	inst->process = app_process->process;	/* Store the process function */
+
 	/*
-	 *	The server core is still RADIUS, and needs a client.
-	 *	So we fake one here.
+	 *	These configuration items are not printed by default,
+	 *	because normal people shouldn't be touching them.
 	 */
-	client = &sock->client;
-	memset(client, 0, sizeof(*client));
-	client->ipaddr.af = AF_INET;
-	client->ipaddr.addr.v4.s_addr = INADDR_NONE;
-	client->ipaddr.prefix = 0;
-	client->longname = client->shortname = sock->lsock.interface;
-	client->secret = client->shortname;
-	client->nas_type = talloc_typed_strdup(sock, "none");
+	if (!inst->default_message_size && inst->app_io) inst->default_message_size = inst->app_io->default_message_size;
 
-	return 0;
-}
+	if (!inst->num_messages) inst->num_messages = 256;
 
-static int arp_socket_print(const rad_listen_t *this, char *buffer, size_t bufsize)
-{
-	arp_socket_t *sock = this->data;
+	FR_INTEGER_BOUND_CHECK("num_messages", inst->num_messages, >=, 32);
+	FR_INTEGER_BOUND_CHECK("num_messages", inst->num_messages, <=, 65535);
 
-	snprintf(buffer, bufsize, "arp interface %s", sock->lsock.interface);
+	FR_INTEGER_BOUND_CHECK("default_message_size", inst->default_message_size, >=, 1024);
+	FR_INTEGER_BOUND_CHECK("default_message_size", inst->default_message_size, <=, 65535);
 
-	return 1;
+	return 0;
 }
 
-/*
- *	If there's no "arp" section, we can't bootstrap anything.
+/** Bootstrap the application
+ *
+ * Bootstrap I/O and type submodules.
+ *
+ * @param[in] instance	Ctx data for this application.
+ * @param[in] conf	Listen section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static int arp_socket_bootstrap(CONF_SECTION *server_cs, UNUSED CONF_SECTION *listen_cs)
+static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
-	CONF_SECTION *cs;
+	proto_arp_t 		*inst = talloc_get_type_abort(instance, proto_arp_t);
+	size_t			i;
+	dl_instance_t		*parent_inst;
+	fr_app_process_t const	*app_process;
 
-	cs = cf_section_find(server_cs, "arp", NULL);
-	if (!cs) {
-		cf_log_err(server_cs, "No 'arp' sub-section found");
-		return -1;
+	/*
+	 *	Listen for requests and replies, unless we're told
+	 *	otherwise.
+	 */
+	if (!inst->types) {
+		inst->code_allowed[ARPOP_REQUEST] = true;
+		inst->code_allowed[ARPOP_REPLY] = true;
 	}
 
-	return 0;
-}
+	for (i = 0; i < talloc_array_length(inst->types); i++) {
+		fr_dict_enum_t const	*type_enum;
+		uint16_t		code;
 
-/*
- *	Ensure that the "arp" section is compiled.
- */
-static int arp_socket_compile(CONF_SECTION *server_cs, UNUSED CONF_SECTION *listen_cs)
-{
-	CONF_SECTION *cs;
+		type_enum = fr_dict_enum_by_alias(NULL, header_attrs[4], inst->types[i]);	/* ARP-Operation */
+		if (!type_enum) {
+			cf_log_err(conf, "Invalid type \"%s\"", inst->types[i]);
+			return -1;
+		}
+
+		code = type_enum->value->vb_uint16;
+		if (!code || (code > FR_ARP_MAX_OPERATION)) {
+			cf_log_err(conf, "Cannot listen for ARP-Operation = '%s'", inst->types[i]);
+			return -1;
+		}
+
+		inst->code_allowed[code] = true;
+	}
+
+	/*
+	 *	All of the packet types use the same process
+	 *	module, which looks up "recv <type>" sections.
+	 *
+	 *	Parent dl_instance_t added in virtual_servers.c (listen_parse)
+	 */
+	parent_inst = cf_data_value(cf_data_find(conf, dl_instance_t, "proto_arp"));
+	rad_assert(parent_inst);
+
+	if (dl_instance(inst, &inst->process_submodule, conf, parent_inst, "base", DL_TYPE_SUBMODULE) < 0) {
+		cf_log_err(conf, "Failed loading process module: %s", fr_strerror());
+		return -1;
+	}
 
-	cs = cf_section_find(server_cs, "arp", NULL);
-	if (!cs) {
-		cf_log_err(server_cs, "No 'arp' sub-section found");
+	app_process = (fr_app_process_t const *)inst->process_submodule->module->common;
+	if (app_process->bootstrap && (app_process->bootstrap(inst->process_submodule->data,
+							      inst->process_submodule->conf) < 0)) {
+		cf_log_err(conf, "Bootstrap failed for \"%s\"", app_process->name);
 		return -1;
 	}
 
-	cf_log_debug(cs, "Loading arp {...}");
+	/*
+	 *	No IO module, it's an empty listener.
+	 */
+	if (!inst->io_submodule) return 0;
 
-	if (unlang_compile(cs, MOD_POST_AUTH) < 0) {
-		cf_log_err(cs, "Failed compiling 'arp' section");
+	/*
+	 *	Bootstrap the I/O module
+	 */
+	inst->app_io = (fr_app_io_t const *) inst->io_submodule->module->common;
+	inst->app_io_instance = inst->io_submodule->data;
+	inst->app_io_conf = inst->io_submodule->conf;
+
+	if (inst->app_io->bootstrap && (inst->app_io->bootstrap(inst->app_io_instance,
+								inst->app_io_conf) < 0)) {
+		cf_log_err(inst->app_io_conf, "Bootstrap failed for \"%s\"", inst->app_io->name);
 		return -1;
 	}
 
 	return 0;
 }
 
+static int mod_load(void)
+{
+	int i;
+
+	for (i = 0; header_names[i].name != NULL; i++) {
+		header_attrs[i] = fr_dict_attr_by_name(NULL, header_names[i].name);
+		if (!header_attrs[i]) {
+			ERROR("Missing definition for %s", header_names[i].name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
 
-extern rad_protocol_t proto_arp;
-rad_protocol_t proto_arp = {
+fr_app_t proto_arp = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "arp",
-	.inst_size	= sizeof(arp_socket_t),
-	.transports	= 0,
-	.tls		= false,
-	.bootstrap	= arp_socket_bootstrap,
-	.compile	= arp_socket_compile,
-	.parse		= arp_socket_parse,
-	.open		= common_socket_open,
-	.recv		= arp_socket_recv,
-	.send		= arp_socket_send,
-	.print		= arp_socket_print,
-	.debug		= common_packet_debug,
-	.encode		= arp_socket_encode,
-	.decode		= arp_socket_decode
+	.config		= proto_arp_config,
+	.inst_size	= sizeof(proto_arp_t),
+
+	.load		= mod_load,
+	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate,
+	.open		= mod_open,
+	.decode		= mod_decode,
+	.process_set	= mod_process_set
 };
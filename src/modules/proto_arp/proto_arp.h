@@ -0,0 +1,79 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _PROTO_ARP_H
+#define _PROTO_ARP_H
+
+#include <freeradius-devel/net.h>
+
+/*
+ * $Id$
+ *
+ * @file proto_arp.h
+ * @brief Structures for the ARP protocol
+ *
+ * @copyright 2013,2017 The FreeRADIUS server project.
+ */
+
+/*
+ *	The highest ARP-Operation we can listen for.
+ */
+#define FR_ARP_MAX_OPERATION	(9)
+
+/*
+ *	ARP for ethernet && IPv4.
+ */
+typedef struct CC_HINT(__packed__) {
+	uint16_t			htype;				//!< Format of hardware address.
+	uint16_t			ptype;				//!< Format of protocol address.
+	uint8_t				hlen;				//!< Length of hardware address.
+	uint8_t				plen;				//!< Length of protocol address.
+	uint16_t			op;				//!< 1 - Request, 2 - Reply.
+	uint8_t				sha[ETHER_ADDR_LEN];		//!< Sender hardware address.
+	uint8_t				spa[4];				//!< Sender protocol address.
+	uint8_t				tha[ETHER_ADDR_LEN];		//!< Target hardware address.
+	uint8_t				tpa[4];				//!< Target protocol address.
+} arp_over_ether_t;
+
+/** An instance of a proto_arp listen section
+ *
+ */
+typedef struct {
+	CONF_SECTION			*server_cs;			//!< server CS for this listener
+
+	dl_instance_t			*io_submodule;			//!< As provided by the transport_parse
+									///< callback.  Broken out into the
+									///< app_io_* fields below for convenience.
+
+	fr_app_io_t const		*app_io;			//!< Easy access to the app_io handle.
+	void				*app_io_instance;		//!< Easy access to the app_io instance.
+	CONF_SECTION			*app_io_conf;			//!< Easy access to the app_io's config section.
+
+	char const			**types;			//!< ARP-Operation values we accept.
+	dl_instance_t			*process_submodule;		//!< One process module handles all types.
+
+	fr_io_process_t			process;			//!< process entry point
+
+	uint32_t			default_message_size;		//!< for message ring buffer
+	uint32_t			num_messages;			//!< for message ring buffer
+
+	bool				code_allowed[FR_ARP_MAX_OPERATION + 1];	//!< Lookup allowed
+									///< ARP-Operation values.
+
+	fr_listen_t const		*listen;			//!< The listener structure which describes
+									///< the I/O path.
+} proto_arp_t;
+
+#endif	/* _PROTO_ARP_H */
@@ -0,0 +1,9 @@
+TARGETNAME	:= proto_arp
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME).a
+endif
+
+SOURCES		:= proto_arp.c
+
+TGT_PREREQS	:= libfreeradius-util.a
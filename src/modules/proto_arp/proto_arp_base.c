@@ -0,0 +1,141 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_arp/proto_arp_base.c
+ * @brief ARP processing.
+ *
+ * We never send ARP packets.  The "recv" sections are there to log, or
+ * to check, what is seen on the network.
+ *
+ * @copyright 2013,2017 The FreeRADIUS server project.
+ * @copyright 2013 Network RADIUS SARL <info@networkradius.com>
+ */
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/protocol.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/rad_assert.h>
+#include "proto_arp.h"
+
+static fr_dict_enum_t const *operation_enum(uint16_t code)
+{
+	fr_dict_attr_t const *da;
+
+	da = fr_dict_attr_by_name(NULL, "ARP-Operation");
+	rad_assert(da != NULL);
+
+	return fr_dict_enum_by_value(NULL, da, fr_box_uint16(code));
+}
+
+static fr_io_final_t mod_process(REQUEST *request, UNUSED fr_io_action_t action)
+{
+	rlm_rcode_t		rcode;
+	CONF_SECTION		*unlang;
+	fr_dict_enum_t const	*dv;
+
+	VERIFY_REQUEST(request);
+
+	switch (request->request_state) {
+	case REQUEST_INIT:
+		dv = operation_enum(request->packet->code);
+
+		radlog_request(L_DBG, L_DBG_LVL_1, request, "Received ARP %s from %pV",
+			       dv ? dv->alias : "Unknown", fr_box_ipaddr(request->packet->src_ipaddr));
+		rdebug_pair_list(L_DBG_LVL_1, request, request->packet->vps, "");
+
+		request->component = "arp";
+
+		unlang = dv ? cf_section_find(request->server_cs, "recv", dv->alias) : NULL;
+		if (!unlang) unlang = cf_section_find(request->server_cs, "recv", "*");
+		if (!unlang) {
+			RDEBUG("No 'recv' section for ARP %s", dv ? dv->alias : "Unknown");
+			return FR_IO_DONE;
+		}
+
+		RDEBUG("Running 'recv %s' from file %s", cf_section_name2(unlang), cf_filename(unlang));
+		unlang_push_section(request, unlang, RLM_MODULE_NOOP);
+
+		request->request_state = REQUEST_RECV;
+		/* FALL-THROUGH */
+
+	case REQUEST_RECV:
+		rcode = unlang_interpret_continue(request);
+
+		if (request->master_state == REQUEST_STOP_PROCESSING) return FR_IO_DONE;
+
+		if (rcode == RLM_MODULE_YIELD) return FR_IO_YIELD;
+
+		rad_assert(request->log.unlang_indent == 0);
+		break;
+
+	default:
+		return FR_IO_FAIL;
+	}
+
+	/*
+	 *	There's never a reply.
+	 */
+	return FR_IO_DONE;
+}
+
+/*
+ *	Ensure that the "recv foo" sections are compiled.
+ */
+static int mod_instantiate(UNUSED void *instance, CONF_SECTION *listen_cs)
+{
+	int		rcode;
+	bool		found = false;
+	uint16_t	code;
+	CONF_SECTION	*server_cs;
+
+	rad_assert(listen_cs);
+
+	server_cs = cf_item_to_section(cf_parent(listen_cs));
+	rad_assert(strcmp(cf_section_name1(server_cs), "server") == 0);
+
+	for (code = 1; code <= FR_ARP_MAX_OPERATION; code++) {
+		fr_dict_enum_t const *dv;
+
+		dv = operation_enum(code);
+		if (!dv) continue;
+
+		rcode = unlang_compile_subsection(server_cs, "recv", dv->alias, MOD_POST_AUTH);
+		if (rcode < 0) return rcode;
+		if (rcode > 0) found = true;
+	}
+
+	rcode = unlang_compile_subsection(server_cs, "recv", "*", MOD_POST_AUTH);
+	if (rcode < 0) return rcode;
+	if (rcode > 0) found = true;
+
+	if (!found) {
+		cf_log_err(server_cs, "Failed finding any 'recv ... { ... }' section of virtual server %s",
+			   cf_section_name2(server_cs));
+		return -1;
+	}
+
+	return 0;
+}
+
+extern fr_app_process_t proto_arp_base;
+fr_app_process_t proto_arp_base = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "arp_base",
+	.instantiate	= mod_instantiate,
+	.process	= mod_process,
+};
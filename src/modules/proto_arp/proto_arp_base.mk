@@ -0,0 +1,9 @@
+TARGETNAME	:= proto_arp_base
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME).a
+endif
+
+SOURCES		:= proto_arp_base.c
+
+TGT_PREREQS	:= libfreeradius-util.a
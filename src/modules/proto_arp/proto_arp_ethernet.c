@@ -0,0 +1,506 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_arp_ethernet.c
+ * @brief ARP handler for Ethernet.
+ *
+ * Frames are captured through a TPACKET_V3 PACKET_MMAP ring.  The
+ * kernel fills whole blocks of frames, and hands a block to us when it
+ * is full, or when "block_timeout" has passed.  We walk the frames in
+ * a block without any system calls, and give the block back when
+ * we're done with it.
+ *
+ * A BPF filter attached to the socket drops everything but ARP for
+ * Ethernet and IPv4, with an ARP-Operation the listener accepts.  So
+ * the rest of the ARP traffic never reaches the ring.
+ *
+ * @copyright 2013,2017 The FreeRADIUS server project.
+ */
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/protocol.h>
+#include <freeradius-devel/io/io.h>
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/rad_assert.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include "proto_arp.h"
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+#  include <linux/if_packet.h>
+#  include <linux/if_ether.h>
+#  include <linux/filter.h>
+#  include <sys/mman.h>
+#endif
+
+/*
+ *	Goes in front of the ARP packet in the message buffer.
+ */
+typedef struct {
+	struct timeval			timestamp;		//!< When the kernel received the frame.
+	int				if_index;
+} proto_arp_ethernet_meta_t;
+
+/** The RX ring, and where we are in it
+ *
+ */
+typedef struct {
+	uint8_t				*map;			//!< The ring, shared with the kernel.
+	size_t				map_len;		//!< Length of the ring.
+
+	uint32_t			block;			//!< Block we're reading from.
+	uint8_t				*frame;			//!< Next frame in the block, or NULL
+								///< if we don't have a block.
+	uint32_t			left;			//!< Frames left in the block.
+} proto_arp_ethernet_ring_t;
+
+typedef struct {
+	proto_arp_t	const		*parent;		//!< The module that spawned us!
+
+	int				sockfd;
+	int				if_index;
+
+	char const			*interface;		//!< Interface to capture on.
+	bool				promiscuous;		//!< See ARP packets for other hosts.
+
+	uint32_t			blocks;			//!< Number of blocks in the ring.
+	uint32_t			block_size;		//!< Size of each block.
+	uint32_t			block_timeout;		//!< Milliseconds before the kernel hands us
+								///< a block which isn't full.
+
+	proto_arp_ethernet_ring_t	*ring;
+} proto_arp_ethernet_t;
+
+static const CONF_PARSER ethernet_listen_config[] = {
+	{ FR_CONF_OFFSET("interface", FR_TYPE_STRING | FR_TYPE_REQUIRED, proto_arp_ethernet_t, interface) },
+	{ FR_CONF_OFFSET("promiscuous", FR_TYPE_BOOL, proto_arp_ethernet_t, promiscuous), .dflt = "yes" },
+
+	{ FR_CONF_OFFSET("blocks", FR_TYPE_UINT32, proto_arp_ethernet_t, blocks), .dflt = "16" },
+	{ FR_CONF_OFFSET("block_size", FR_TYPE_UINT32, proto_arp_ethernet_t, block_size), .dflt = "65536" },
+	{ FR_CONF_OFFSET("block_timeout", FR_TYPE_UINT32, proto_arp_ethernet_t, block_timeout), .dflt = "10" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+/** Fill in the timestamp, and point the packet at the ARP data
+ *
+ */
+static int mod_decode(UNUSED void const *instance, REQUEST *request, uint8_t *const data, size_t data_len)
+{
+	proto_arp_ethernet_meta_t meta;
+
+	if (data_len < sizeof(meta)) return -1;
+
+	memcpy(&meta, data, sizeof(meta));
+
+	request->packet->timestamp = meta.timestamp;
+	request->packet->if_index = meta.if_index;
+
+	request->packet->data = data + sizeof(meta);
+	request->packet->data_len = data_len - sizeof(meta);
+
+	return 0;
+}
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+/** Give a block back to the kernel, and move on to the next one
+ *
+ */
+static void mod_block_release(proto_arp_ethernet_t const *inst, struct tpacket_block_desc *block)
+{
+	proto_arp_ethernet_ring_t *ring = inst->ring;
+
+	/*
+	 *	We have to be finished with the frames before the
+	 *	kernel sees the status change.
+	 */
+	__sync_synchronize();
+	block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+
+	ring->block = (ring->block + 1) % inst->blocks;
+	ring->frame = NULL;
+	ring->left = 0;
+}
+#endif
+
+/** Read a packet from the ring
+ *
+ *  Each call returns the next frame of the current block.  When the
+ *  block is used up, it goes back to the kernel, and we move on to the
+ *  next one.  We only return 0 when the kernel hasn't given us another
+ *  block.
+ */
+static ssize_t mod_read(void const *instance, void **packet_ctx, fr_time_t **recv_time, uint8_t *buffer, size_t buffer_len)
+{
+#ifdef HAVE_LINUX_IF_PACKET_H
+	proto_arp_ethernet_t const	*inst = talloc_get_type_abort(instance, proto_arp_ethernet_t);
+	proto_arp_ethernet_ring_t	*ring = inst->ring;
+	proto_arp_ethernet_meta_t	meta;
+	struct tpacket_block_desc	*block;
+	struct tpacket3_hdr		*hdr;
+	size_t				packet_len;
+
+	for (;;) {
+		block = (struct tpacket_block_desc *) (ring->map + ((size_t) ring->block * inst->block_size));
+
+		if (!ring->frame) {
+			if ((block->hdr.bh1.block_status & TP_STATUS_USER) == 0) return 0;
+
+			/*
+			 *	Don't look at the frames until we've
+			 *	seen the status.
+			 */
+			__sync_synchronize();
+
+			ring->frame = ((uint8_t *) block) + block->hdr.bh1.offset_to_first_pkt;
+			ring->left = block->hdr.bh1.num_pkts;
+		}
+
+		if (!ring->left) {
+			mod_block_release(inst, block);
+			continue;
+		}
+
+		hdr = (struct tpacket3_hdr *) ring->frame;
+		ring->frame += hdr->tp_next_offset;
+		ring->left--;
+
+		/*
+		 *	The filter only passes complete ARP packets,
+		 *	but the frame may have been truncated anyway.
+		 */
+		packet_len = hdr->tp_snaplen;
+		if ((packet_len < sizeof(arp_over_ether_t)) || ((sizeof(meta) + packet_len) > buffer_len)) continue;
+
+		meta.timestamp.tv_sec = hdr->tp_sec;
+		meta.timestamp.tv_usec = hdr->tp_nsec / 1000;
+		meta.if_index = inst->if_index;
+
+		memcpy(buffer, &meta, sizeof(meta));
+		memcpy(buffer + sizeof(meta), ((uint8_t *) hdr) + hdr->tp_net, packet_len);
+
+		/*
+		 *	That was the last frame.  Give the block back
+		 *	now, so the kernel can refill it while the
+		 *	packet is processed.
+		 */
+		if (!ring->left) mod_block_release(inst, block);
+
+		*packet_ctx = buffer;
+		*recv_time = NULL;
+
+		return sizeof(meta) + packet_len;
+	}
+#else
+	fr_strerror_printf("ARP capture is not supported on this system");
+	return -1;
+#endif
+}
+
+/** ARP packets are never replied to
+ *
+ */
+static ssize_t mod_write(UNUSED void const *instance, UNUSED void *packet_ctx,
+			 UNUSED fr_time_t request_time, UNUSED uint8_t *buffer, size_t buffer_len)
+{
+	return buffer_len;
+}
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+/*
+ *	Jump offsets in the filter are relative to the next instruction.
+ */
+#define ARP_FILTER_HEADER	(7)
+
+/** Attach a BPF filter which passes only the ARP packets we want
+ *
+ *  On a SOCK_DGRAM packet socket, offset 0 is the start of the ARP
+ *  header.
+ */
+static int mod_filter_attach(proto_arp_ethernet_t const *inst)
+{
+	struct sock_filter	code[ARP_FILTER_HEADER + FR_ARP_MAX_OPERATION + 2];
+	struct sock_fprog	prog;
+	unsigned int		num_ops = 0, drop, i;
+	uint16_t		op;
+
+	for (op = 1; op <= FR_ARP_MAX_OPERATION; op++) {
+		if (inst->parent->code_allowed[op]) num_ops++;
+	}
+	drop = ARP_FILTER_HEADER + num_ops;
+
+	code[0] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 0);
+	code[1] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ARPHRD_ETHER, 0, drop - 2);
+	code[2] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 2);
+	code[3] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, drop - 4);
+	code[4] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4);
+	code[5] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (ETH_ALEN << 8) | 4, 0, drop - 6);
+	code[6] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6);
+
+	i = ARP_FILTER_HEADER;
+	for (op = 1; op <= FR_ARP_MAX_OPERATION; op++) {
+		if (!inst->parent->code_allowed[op]) continue;
+
+		code[i] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, op, drop - i, 0);
+		i++;
+	}
+
+	code[drop] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0);
+	code[drop + 1] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0xffff);
+
+	prog.len = drop + 2;
+	prog.filter = code;
+
+	if (setsockopt(inst->sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		fr_strerror_printf("Failed attaching filter: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Set up the TPACKET_V3 RX ring
+ *
+ */
+static int mod_ring_alloc(proto_arp_ethernet_t *inst)
+{
+	proto_arp_ethernet_ring_t	*ring;
+	struct tpacket_req3		req;
+	int				version = TPACKET_V3;
+
+	if (setsockopt(inst->sockfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		fr_strerror_printf("Failed setting TPACKET_V3: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = inst->block_size;
+	req.tp_block_nr = inst->blocks;
+	req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+	req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) * req.tp_block_nr;
+	req.tp_retire_blk_tov = inst->block_timeout;
+
+	if (setsockopt(inst->sockfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+		fr_strerror_printf("Failed creating RX ring: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	ring = talloc_zero(inst, proto_arp_ethernet_ring_t);
+	if (!ring) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	ring->map_len = (size_t) req.tp_block_size * req.tp_block_nr;
+	ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, inst->sockfd, 0);
+	if (ring->map == MAP_FAILED) {
+		fr_strerror_printf("Failed mapping RX ring: %s", fr_syserror(errno));
+		talloc_free(ring);
+		return -1;
+	}
+
+	inst->ring = ring;
+
+	return 0;
+}
+#endif
+
+/** Open a packet socket, and its RX ring
+ *
+ * @param[in] instance of the ARP Ethernet I/O path.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int mod_open(void *instance)
+{
+#ifdef HAVE_LINUX_IF_PACKET_H
+	proto_arp_ethernet_t	*inst = talloc_get_type_abort(instance, proto_arp_ethernet_t);
+	struct sockaddr_ll	link_layer;
+
+	inst->if_index = if_nametoindex(inst->interface);
+	if (!inst->if_index) {
+		ERROR("Failed finding interface %s: %s", inst->interface, fr_syserror(errno));
+		return -1;
+	}
+
+	inst->sockfd = socket(PF_PACKET, SOCK_DGRAM, htons(ETH_P_ARP));
+	if (inst->sockfd < 0) {
+		ERROR("Failed opening packet socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if (fr_nonblock(inst->sockfd) < 0) {
+		ERROR("Failed setting socket to non-blocking: %s", fr_strerror());
+	error:
+		close(inst->sockfd);
+		inst->sockfd = -1;
+		return -1;
+	}
+
+	/*
+	 *	Attach the filter before binding, so that we never
+	 *	see anything it would have dropped.
+	 */
+	if (mod_filter_attach(inst) < 0) {
+		ERROR("%s", fr_strerror());
+		goto error;
+	}
+
+	if (mod_ring_alloc(inst) < 0) {
+		ERROR("%s", fr_strerror());
+		goto error;
+	}
+
+	memset(&link_layer, 0, sizeof(link_layer));
+	link_layer.sll_family = AF_PACKET;
+	link_layer.sll_protocol = htons(ETH_P_ARP);
+	link_layer.sll_ifindex = inst->if_index;
+
+	if (bind(inst->sockfd, (struct sockaddr *) &link_layer, sizeof(link_layer)) < 0) {
+		ERROR("Failed binding to interface %s: %s", inst->interface, fr_syserror(errno));
+		goto error;
+	}
+
+	if (inst->promiscuous) {
+		struct packet_mreq mreq;
+
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.mr_ifindex = inst->if_index;
+		mreq.mr_type = PACKET_MR_PROMISC;
+
+		if (setsockopt(inst->sockfd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+			WARN("Failed setting interface %s to promiscuous mode: %s",
+			     inst->interface, fr_syserror(errno));
+		}
+	}
+
+	return 0;
+#else
+	proto_arp_ethernet_t	*inst = talloc_get_type_abort(instance, proto_arp_ethernet_t);
+
+	ERROR("Capturing ARP on %s is not supported on this system", inst->interface);
+	return -1;
+#endif
+}
+
+/** Get the file descriptor for this socket.
+ *
+ * @param[in] instance of the ARP Ethernet I/O path.
+ * @return the file descriptor
+ */
+static int mod_fd(void const *instance)
+{
+	proto_arp_ethernet_t *inst = talloc_get_type_abort(instance, proto_arp_ethernet_t);
+
+	return inst->sockfd;
+}
+
+/** Close the socket, and unmap the ring.
+ *
+ * @param[in] instance of the ARP Ethernet I/O path.
+ * @return
+ *	- 0 on success.
+ */
+static int mod_close(void const *instance)
+{
+	proto_arp_ethernet_t *inst;
+
+	memcpy(&inst, &instance, sizeof(inst)); /* const issues */
+
+	inst = talloc_get_type_abort(inst, proto_arp_ethernet_t);
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+	if (inst->ring) {
+		munmap(inst->ring->map, inst->ring->map_len);
+		TALLOC_FREE(inst->ring);
+	}
+#endif
+
+	if (inst->sockfd >= 0) close(inst->sockfd);
+	inst->sockfd = -1;
+
+	return 0;
+}
+
+static int mod_instantiate(void *instance, UNUSED CONF_SECTION *cs)
+{
+	proto_arp_ethernet_t *inst = talloc_get_type_abort(instance, proto_arp_ethernet_t);
+
+	FR_INTEGER_BOUND_CHECK("blocks", inst->blocks, >=, 2);
+	FR_INTEGER_BOUND_CHECK("blocks", inst->blocks, <=, 1024);
+
+	/*
+	 *	Blocks have to be a multiple of the page size.
+	 */
+	FR_INTEGER_BOUND_CHECK("block_size", inst->block_size, >=, 4096);
+	FR_INTEGER_BOUND_CHECK("block_size", inst->block_size, <=, 4194304);
+	inst->block_size = (inst->block_size + 4095) & ~4095;
+
+	FR_INTEGER_BOUND_CHECK("block_timeout", inst->block_timeout, >=, 1);
+	FR_INTEGER_BOUND_CHECK("block_timeout", inst->block_timeout, <=, 1000);
+
+	return 0;
+}
+
+static int mod_bootstrap(void *instance, UNUSED CONF_SECTION *cs)
+{
+	proto_arp_ethernet_t	*inst = talloc_get_type_abort(instance, proto_arp_ethernet_t);
+	dl_instance_t const	*dl_inst;
+
+	/*
+	 *	Find the dl_instance_t holding our instance data
+	 *	so we can find out what the parent of our instance
+	 *	was.
+	 */
+	dl_inst = dl_instance_find(instance);
+	rad_assert(dl_inst);
+
+	inst->parent = talloc_get_type_abort(dl_inst->parent->data, proto_arp_t);
+
+	inst->sockfd = -1;
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	proto_arp_ethernet_t	*inst = talloc_get_type_abort(instance, proto_arp_ethernet_t);
+
+	return mod_close(inst);
+}
+
+extern fr_app_io_t proto_arp_ethernet;
+fr_app_io_t proto_arp_ethernet = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "arp_ethernet",
+	.config			= ethernet_listen_config,
+	.inst_size		= sizeof(proto_arp_ethernet_t),
+	.detach			= mod_detach,
+	.bootstrap		= mod_bootstrap,
+	.instantiate		= mod_instantiate,
+
+	.default_message_size	= 1024,
+	.max_reads		= 256,
+	.open			= mod_open,
+	.close			= mod_close,
+	.read			= mod_read,
+	.decode			= mod_decode,
+	.write			= mod_write,
+	.fd			= mod_fd,
+};
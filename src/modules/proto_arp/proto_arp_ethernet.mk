@@ -0,0 +1,9 @@
+TARGETNAME	:= proto_arp_ethernet
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME).a
+endif
+
+SOURCES		:= proto_arp_ethernet.c
+
+TGT_PREREQS	:= libfreeradius-util.a
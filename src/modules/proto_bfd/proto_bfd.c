@@ -27,6 +27,7 @@
 #include <freeradius-devel/event.h>
 #include <freeradius-devel/md5.h>
 #include <freeradius-devel/sha1.h>
+#include <freeradius-devel/udp.h>
 
 #define USEC (1000000)
 #define BFD_MAX_SECRET_LENGTH 20
@@ -61,18 +62,17 @@ typedef enum bfd_auth_type_t {
 
 #define BFD_AUTH_INVALID (BFD_AUTH_MET_KEYED_SHA1 + 1)
 
+typedef struct bfd_thread_t bfd_thread_t;
+
 typedef struct bfd_state_t {
 	int		number;
 	int		sockfd;
 
+	bfd_thread_t	*thread;
 	fr_event_list_t *el;
 	CONF_SECTION	*server_cs;
 	CONF_SECTION	*unlang;
 
-	bool		blocked;
-	int		pipefd[2];
-	pthread_t	pthread_id;
-
 	bfd_auth_type_t auth_type;
 	uint8_t		secret[BFD_MAX_SECRET_LENGTH];
 	size_t		secret_len;
@@ -82,12 +82,6 @@ typedef struct bfd_state_t {
 	uint16_t	local_port;
 	uint16_t	remote_port;
 
-	/*
-	 *	To simplify sending the packets.
-	 */
-	struct sockaddr_storage remote_sockaddr;
-	socklen_t	salen;
-
 	fr_event_timer_t const	*ev_timeout;
 	fr_event_timer_t const	*ev_packet;
 	struct timeval	last_recv;
@@ -225,8 +219,45 @@ typedef struct bfd_socket_t {
 	size_t		secret_len;
 
 	rbtree_t	*session_tree;
+
+	uint32_t	num_threads;
+	bfd_thread_t	*threads;
 } bfd_socket_t;
 
+/*
+ *	Sessions are spread across a small number of threads.  Each
+ *	thread runs one event loop, which contains the timers for all
+ *	of its sessions.  The listener passes packets to the thread
+ *	over a pipe.
+ */
+struct bfd_thread_t {
+	int		number;
+	bfd_socket_t	*sock;
+	int		sockfd;
+
+	fr_event_list_t	*el;
+	int		pipefd[2];
+	pthread_t	pthread_id;
+
+	/*
+	 *	Packets are queued as the timers fire, and sent
+	 *	together before the event loop waits again.
+	 */
+	int		num_outgoing;
+	bfd_packet_t	outgoing[UDP_BATCH_MAX];
+	udp_datagram_t	dg[UDP_BATCH_MAX];
+};
+
+/*
+ *	What the listener writes to the pipe.  It's much smaller than
+ *	PIPE_BUF, so each write is atomic, and the thread always
+ *	reads whole messages.
+ */
+typedef struct bfd_thread_msg_t {
+	bfd_state_t	*session;
+	bfd_packet_t	packet;
+} bfd_thread_msg_t;
+
 static int bfd_start_packets(bfd_state_t *session);
 static int bfd_start_control(bfd_state_t *session);
 static int bfd_stop_control(bfd_state_t *session);
@@ -242,106 +273,175 @@ void bfd_init(fr_event_list_t *xel)
 	event_list = xel;
 }
 
-static void bfd_pthread_free(bfd_state_t *session)
+/*
+ *	Send the queued packets, with as few system calls as possible.
+ *
+ *	This is called by the event loop before it waits for more
+ *	events.
+ */
+static int bfd_thread_flush(void *ctx, UNUSED struct timeval *wake)
+{
+	bfd_thread_t *thread = ctx;
+	int sent;
+
+	if (!thread->num_outgoing) return 0;
+
+	sent = udp_send_batch(thread->sockfd, thread->dg, thread->num_outgoing);
+	if (sent < thread->num_outgoing) {
+		ERROR("BFD thread %d failed sending %d of %d packets",
+		      thread->number, thread->num_outgoing - sent, thread->num_outgoing);
+	}
+
+	thread->num_outgoing = 0;
+
+	return 0;
+}
+
+/*
+ *	Queue a packet to be sent by bfd_thread_flush()
+ */
+static void bfd_queue_packet(bfd_state_t *session, bfd_packet_t *bfd)
 {
-	session->blocked = true;
+	bfd_thread_t *thread = session->thread;
+	udp_datagram_t *dg;
 
-	close(session->pipefd[0]);
-	close(session->pipefd[1]);
+	if (thread->num_outgoing == UDP_BATCH_MAX) bfd_thread_flush(thread, NULL);
 
-	talloc_free(session->el);
+	memcpy(&thread->outgoing[thread->num_outgoing], bfd, bfd->length);
 
-	session->el = NULL;
-	session->pipefd[0] = session->pipefd[1] = -1;
+	dg = &thread->dg[thread->num_outgoing];
+	memset(dg, 0, sizeof(*dg));
+	dg->data = (uint8_t *) &thread->outgoing[thread->num_outgoing];
+	dg->data_len = bfd->length;
+	dg->dst_ipaddr = session->remote_ipaddr;
+	dg->dst_port = session->remote_port;
 
-	session->blocked = false;
+	thread->num_outgoing++;
 }
 
 /*
- *	A child thread reads the packet from a pipe, and processes it.
+ *	A thread reads packets from a pipe, and processes them.
  */
 static void bfd_pipe_recv(UNUSED fr_event_list_t *xel, int fd, UNUSED int flags, void *ctx)
 {
 	ssize_t num;
-	bfd_state_t *session = ctx;
-	bfd_packet_t bfd;
+	size_t i;
+	bfd_thread_t *thread = ctx;
+	bfd_thread_msg_t msg[UDP_BATCH_MAX];
+
+	while ((num = read(fd, msg, sizeof(msg))) > 0) {
+		if ((num % sizeof(msg[0])) != 0) {
+			ERROR("BFD thread %d read a partial message from the pipe!", thread->number);
+			return;
+		}
 
-	if (session->blocked) return;
+		for (i = 0; i < (num / sizeof(msg[0])); i++) {
+			bfd_process(msg[i].session, &msg[i].packet);
+		}
 
-	/*
-	 *	Read the header
-	 */
-	num = read(fd, &bfd, 4);
-	if ((num < 4) || (bfd.length < 4)) {
-	fail:
-		ERROR("BFD Failed reading from pipe!");
-		session->blocked = true;
-		return;
+		if ((size_t) num < sizeof(msg)) return;
 	}
 
-	/*
-	 *	This is already checked in the caller, but what the heck...
-	 */
-	if (bfd.length > sizeof(bfd)) goto fail;
+	if ((num < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+		ERROR("BFD thread %d failed reading from pipe: %s", thread->number, fr_syserror(errno));
+	}
+}
 
-	/*
-	 *	Read the rest of the packet.
-	 */
-	num = read(fd, ((uint8_t *) &bfd) + 4, bfd.length - 4);
-	if ((num < 0) || ((num + 4) != bfd.length)) goto fail;
+static int bfd_thread_start_session(void *ctx, void *data)
+{
+	bfd_thread_t *thread = ctx;
+	bfd_state_t *session = data;
+
+	if (session->thread == thread) bfd_start_control(session);
 
-	bfd_process(session, &bfd);
+	return 0;
 }
 
 /*
- *	Do nothing more than read from the sockets and process the
+ *	Do nothing more than read from the pipe and process the
  *	timers.
  */
 static void *bfd_child_thread(void *ctx)
 {
-	bfd_state_t *session = ctx;
+	bfd_thread_t *thread = ctx;
 
-	DEBUG("BFD %d starting child thread", session->number);
-	bfd_start_control(session);
+	DEBUG("BFD starting thread %d", thread->number);
 
-	fr_event_loop(session->el);
+	rbtree_walk(thread->sock->session_tree, RBTREE_IN_ORDER, bfd_thread_start_session, thread);
 
-	bfd_pthread_free(session);
+	fr_event_loop(thread->el);
 
 	return NULL;
 }
 
-
-static int bfd_pthread_create(bfd_state_t *session)
+/*
+ *	Set up the event loop for a thread.  Sessions can then be
+ *	assigned to it.
+ */
+static int bfd_thread_init(bfd_socket_t *sock, bfd_thread_t *thread, int number, int sockfd)
 {
-	int rcode;
-	pthread_attr_t attr;
+	thread->number = number;
+	thread->sock = sock;
+	thread->sockfd = sockfd;
+	thread->pipefd[0] = thread->pipefd[1] = -1;
 
-	if (pipe(session->pipefd) < 0) {
-		ERROR("Failed opening pipe: %s", fr_syserror(errno));
+	/*
+	 *	Non-threaded operation.  Everything runs in the
+	 *	main event loop.
+	 */
+	if (event_list) {
+		thread->el = event_list;
+		thread->pthread_id = pthread_self();
+
+		if (fr_event_pre_insert(thread->el, bfd_thread_flush, thread) < 0) {
+			PERROR("Failed inserting BFD callback into event list");
+			return -1;
+		}
 		return 0;
 	}
 
-	session->el = fr_event_list_alloc(session, NULL, NULL);
-	if (!session->el) {
-		ERROR("Failed creating event list");
-	close_pipes:
-		close(session->pipefd[0]);
-		close(session->pipefd[1]);
-		session->pipefd[0] = session->pipefd[1] = -1;
-		return 0;
+	if (pipe(thread->pipefd) < 0) {
+		ERROR("Failed opening pipe: %s", fr_syserror(errno));
+		return -1;
 	}
 
 #ifdef O_NONBLOCK
-	fcntl(session->pipefd[0], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
-	fcntl(session->pipefd[1], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
+	fcntl(thread->pipefd[0], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
+	fcntl(thread->pipefd[1], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
 #endif
 
-	if (fr_event_fd_insert(session, session->el, session->pipefd[0], bfd_pipe_recv, NULL, NULL, session) < 0) {
+	thread->el = fr_event_list_alloc(sock, bfd_thread_flush, thread);
+	if (!thread->el) {
+		ERROR("Failed creating event list");
+	close_pipes:
+		close(thread->pipefd[0]);
+		close(thread->pipefd[1]);
+		thread->pipefd[0] = thread->pipefd[1] = -1;
+		return -1;
+	}
+
+	/*
+	 *	Every packet we receive moves the detection timer
+	 *	of its session.  The timing wheel makes that O(1).
+	 */
+	fr_event_list_timer_wheel(thread->el, true);
+
+	if (fr_event_fd_insert(sock, thread->el, thread->pipefd[0], bfd_pipe_recv, NULL, NULL, thread) < 0) {
 		PERROR("Failed inserting file descriptor into event list");
+		TALLOC_FREE(thread->el);
 		goto close_pipes;
 	}
 
+	return 0;
+}
+
+static int bfd_thread_create(bfd_thread_t *thread)
+{
+	int rcode;
+	pthread_attr_t attr;
+
+	if (event_list) return 0;
+
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
@@ -352,17 +452,15 @@ static int bfd_pthread_create(bfd_state_t *session)
 	 *	Note that the function returns non-zero on error, NOT
 	 *	-1.  The return code is the error, and errno isn't set.
 	 */
-	rcode = pthread_create(&session->pthread_id, &attr,
-			       bfd_child_thread, session);
+	rcode = pthread_create(&thread->pthread_id, &attr,
+			       bfd_child_thread, thread);
+	pthread_attr_destroy(&attr);
 	if (rcode != 0) {
-		talloc_free(session->el);
-		session->el = NULL;
 		ERROR("Thread create failed: %s", fr_syserror(rcode));
-		goto close_pipes;
+		return -1;
 	}
-	pthread_attr_destroy(&attr);
 
-	return 1;
+	return 0;
 }
 
 static const char *bfd_state[] = {
@@ -408,13 +506,10 @@ static void bfd_session_free(void *ctx)
 {
 	bfd_state_t *session = ctx;
 
-	if (event_list != session->el) {
-		/*
-		 *	FIXME: this isn't particularly safe.
-		 */
-		bfd_pthread_free(session);
-	}
-
+	/*
+	 *	FIXME: this isn't particularly safe if the session's
+	 *	thread is still running.
+	 */
 	talloc_free(session);
 }
 
@@ -502,14 +597,14 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 
 	rcode = cf_pair_parse(NULL, cs, "min_transmit_interval", FR_ITEM_POINTER(FR_TYPE_UINT32, &number), NULL, T_INVALID);
 	if (rcode == 0) {
-		if (number < 100) number = 100;
+		if (number < 10) number = 10;
 		if (number > 10000) number = 10000;
 
 		session->desired_min_tx_interval = number * 1000;
 	}
 	rcode = cf_pair_parse(NULL, cs, "min_receive_interval", FR_ITEM_POINTER(FR_TYPE_UINT32, &number), NULL, T_INVALID);
 	if (rcode == 0) {
-		if (number < 100) number = 100;
+		if (number < 10) number = 10;
 		if (number > 10000) number = 10000;
 
 		session->required_min_rx_interval = number * 1000;
@@ -559,8 +654,8 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 	session->local_ipaddr = sock->my_ipaddr;
 	session->local_port = sock->my_port;
 
-	fr_ipaddr_to_sockaddr(ipaddr, port,
-			   &session->remote_sockaddr, &session->salen);
+	session->thread = &sock->threads[session->number % sock->num_threads];
+	session->el = session->thread->el;
 
 	if (!rbtree_insert(sock->session_tree, session)) {
 		ERROR("FAILED creating new session!");
@@ -571,22 +666,10 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 	bfd_trigger(session);
 
 	/*
-	 *	Check for threaded / non-threaded operation.
+	 *	In threaded operation, the session's thread starts
+	 *	it when the thread starts.
 	 */
-	if (event_list) {
-		session->el = event_list;
-
-		bfd_start_control(session);
-
-		session->pipefd[0] = session->pipefd[1] = -1;
-		session->pthread_id = pthread_self();
-	} else {
-		if (!bfd_pthread_create(session)) {
-			rbtree_deletebydata(sock->session_tree, session);
-			talloc_free(session);
-			return NULL;
-		}
-	}
+	if (event_list) bfd_start_control(session);
 
 	return session;
 }
@@ -873,11 +956,7 @@ static void bfd_send_packet(UNUSED fr_event_list_t *eel, UNUSED struct timeval *
 
 	DEBUG("BFD %d sending packet state %s",
 	      session->number, bfd_state[session->session_state]);
-	if (sendto(session->sockfd, &bfd, bfd.length, 0,
-		   (struct sockaddr *) &session->remote_sockaddr,
-		   session->salen) < 0) {
-		ERROR("Failed sending packet: %s", fr_syserror(errno));
-	}
+	bfd_queue_packet(session, &bfd);
 }
 
 static int bfd_start_packets(bfd_state_t *session)
@@ -887,10 +966,9 @@ static int bfd_start_packets(bfd_state_t *session)
 	struct timeval now;
 
 	/*
-	 *	Reset the timers.
+	 *	Inserting the timer re-uses the existing event, if
+	 *	there is one.
 	 */
-	fr_event_timer_delete(session->el, &session->ev_packet);
-
 	gettimeofday(&session->last_sent, NULL);
 	now = session->last_sent;
 
@@ -937,8 +1015,11 @@ static void bfd_set_timeout(bfd_state_t *session, struct timeval *when)
 {
 	struct timeval now = *when;
 
-	fr_event_timer_delete(session->el, &session->ev_timeout);
-
+	/*
+	 *	This is called for every packet we receive, so the
+	 *	existing event is moved, rather than freed and
+	 *	allocated again.
+	 */
 	if (session->detection_time >= USEC) {
 		now.tv_sec += session->detection_time / USEC;
 	}
@@ -1143,11 +1224,7 @@ static void bfd_poll_response(bfd_state_t *session)
 
 	bfd_sign(session, &bfd);
 
-	if (sendto(session->sockfd, &bfd, bfd.length, 0,
-		   (struct sockaddr *) &session->remote_sockaddr,
-		   session->salen) < 0) {
-		ERROR("Failed sending poll response: %s", fr_syserror(errno));
-	}
+	bfd_queue_packet(session, &bfd);
 }
 
 
@@ -1503,35 +1580,23 @@ static int bfd_socket_recv(rad_listen_t *listener)
 	}
 
 	if (!event_list) {
-		uint8_t *p = (uint8_t *) &bfd;
-		size_t total = bfd.length;
+		bfd_thread_msg_t msg;
 
-		/*
-		 *	A child has had a problem.  Do some cleanups.
-		 */
-		if (session->blocked) bfd_pthread_free(session);
+		msg.session = session;
+		msg.packet = bfd;
+
+		do {
+			rcode = write(session->thread->pipefd[1], &msg, sizeof(msg));
+		} while ((rcode < 0) && (errno == EINTR));
 
 		/*
-		 *	No event list, try to create a new one.
+		 *	The thread is too far behind.  Drop the
+		 *	packet, just as the network would.
 		 */
-		if (!session->el && !bfd_pthread_create(session)) {
-			DEBUG("BFD %d - error trying to create child thread",
-			      session->number);
-			return 0;
+		if (rcode < 0) {
+			DEBUG("BFD %d - dropping packet for thread %d: %s",
+			      session->number, session->thread->number, fr_syserror(errno));
 		}
-
-		do {
-			rcode = write(session->pipefd[1], p, total);
-			if ((rcode < 0) && (errno == EINTR)) continue;
-
-			if (rcode < 0) {
-				session->blocked = true;
-				return 0;
-			}
-
-			total -= rcode;
-			p += rcode;
-		} while (total > 0);
 		return 0;
 	}
 
@@ -1670,6 +1735,8 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 
 	if (cf_pair_parse(sock, cs, "interface", FR_ITEM_POINTER(FR_TYPE_STRING, &sock->interface), NULL, T_INVALID) < 0) return -1;
 
+	if (cf_pair_parse(sock, cs, "min_transmit_interval", FR_ITEM_POINTER(FR_TYPE_UINT32,
+			  &sock->min_tx_interval), "1000", T_BARE_WORD) < 0) return -1;
 	if (cf_pair_parse(sock, cs, "min_receive_interval", FR_ITEM_POINTER(FR_TYPE_UINT32,
 			  &sock->min_rx_interval), "1000", T_BARE_WORD) < 0) return -1;
 	if (cf_pair_parse(sock, cs, "max_timeouts", FR_ITEM_POINTER(FR_TYPE_UINT32,
@@ -1678,6 +1745,8 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 			  "no", T_DOUBLE_QUOTED_STRING) < 0) return -1;
 	if (cf_pair_parse(NULL, cs, "auth_type", FR_ITEM_POINTER(FR_TYPE_STRING, &auth_type_str),
 			  NULL, T_INVALID) < 0) return -1;
+	if (cf_pair_parse(sock, cs, "threads", FR_ITEM_POINTER(FR_TYPE_UINT32,
+			  &sock->num_threads), "1", T_BARE_WORD) < 0) return -1;
 
 	if (!this->server) {
 		char const *server;
@@ -1688,15 +1757,18 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 		sock->server_cs = this->server_cs;
 	}
 
-	if (sock->min_tx_interval < 100) sock->min_tx_interval = 100;
+	if (sock->min_tx_interval < 10) sock->min_tx_interval = 10;
 	if (sock->min_tx_interval > 10000) sock->min_tx_interval = 10000;
 
-	if (sock->min_rx_interval < 100) sock->min_rx_interval = 100;
+	if (sock->min_rx_interval < 10) sock->min_rx_interval = 10;
 	if (sock->min_rx_interval > 10000) sock->min_rx_interval = 10000;
 
 	if (sock->max_timeouts == 0) sock->max_timeouts = 1;
 	if (sock->max_timeouts > 10) sock->max_timeouts = 10;
 
+	if (sock->num_threads == 0) sock->num_threads = 1;
+	if (sock->num_threads > 64) sock->num_threads = 64;
+
 	sock->auth_type = fr_str2int(auth_types, auth_type_str, BFD_AUTH_INVALID);
 	if (sock->auth_type == BFD_AUTH_INVALID) {
 		ERROR("Unknown auth_type '%s'", auth_type_str);
@@ -1742,6 +1814,7 @@ static int bfd_socket_open(CONF_SECTION *cs, rad_listen_t *this)
 {
 	int rcode;
 	uint16_t port;
+	uint32_t i;
 	bfd_socket_t *sock = this->data;
 
 	port = sock->my_port;
@@ -1770,6 +1843,19 @@ static int bfd_socket_open(CONF_SECTION *cs, rad_listen_t *this)
 		return -1;
 	}
 
+	/*
+	 *	Without worker threads, everything runs in the main
+	 *	event loop.
+	 */
+	if (event_list) sock->num_threads = 1;
+
+	sock->threads = talloc_zero_array(sock, bfd_thread_t, sock->num_threads);
+	if (!sock->threads) exit(1);
+
+	for (i = 0; i < sock->num_threads; i++) {
+		if (bfd_thread_init(sock, &sock->threads[i], i, this->fd) < 0) exit(1);
+	}
+
 	/*
 	 *	Bootstrap the initial set of connections.
 	 */
@@ -1777,6 +1863,10 @@ static int bfd_socket_open(CONF_SECTION *cs, rad_listen_t *this)
 		exit(1);
 	}
 
+	for (i = 0; i < sock->num_threads; i++) {
+		if (bfd_thread_create(&sock->threads[i]) < 0) exit(1);
+	}
+
 	return 0;
 }
 
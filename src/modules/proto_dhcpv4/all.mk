@@ -1 +1 @@
-SUBMAKEFILES := proto_dhcpv4.mk rlm_dhcpv4.mk dhcpclient.mk
+SUBMAKEFILES := proto_dhcpv4.mk proto_dhcpv4_base.mk proto_dhcpv4_udp.mk rlm_dhcpv4.mk dhcpclient.mk
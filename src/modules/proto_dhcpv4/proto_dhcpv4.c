@@ -1,8 +1,4 @@
 /*
- * proto_dhcp.c	DHCP processing.
- *
- * Version:	$Id$
- *
  *   This program is free software; you can redistribute it and/or modify
  *   it under the terms of the GNU General Public License as published by
  *   the Free Software Foundation; either version 2 of the License, or
@@ -16,9 +12,15 @@
  *   You should have received a copy of the GNU General Public License
  *   along with this program; if not, write to the Free Software
  *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_dhcpv4.c
+ * @brief DHCPv4 master protocol handler.
  *
- * Copyright 2008 The FreeRADIUS server project
- * Copyright 2008,2016 Alan DeKok <aland@deployingradius.com>
+ * @copyright 2017 The FreeRADIUS server project.
+ * @copyright 2008,2016 Alan DeKok (aland@deployingradius.com)
  */
 
 /*
@@ -28,1052 +30,388 @@
  *	INADDR_ANY : 68 -> INADDR_BROADCAST : 67	REQUEST
  *	CLIENT_IP : 68 <- DHCP_SERVER_IP : 67		ACK
  *
- * Relay sequence:
- *	INADDR_ANY : 68 -> INADDR_BROADCAST : 67	DISCOVER
- *	RELAY_IP : 67 -> NEXT_SERVER_IP : 67		DISCOVER
- *				(NEXT_SERVER_IP can be a relay itself)
- *	FIRST_RELAY_IP : 67 <- DHCP_SERVER_IP : 67	OFFER
- *	CLIENT_IP : 68 <- FIRST_RELAY_IP : 67		OFFER
- *	INADDR_ANY : 68 -> INADDR_BROADCAST : 67	REQUEST
- *	RELAY_IP : 67 -> NEXT_SERVER_IP : 67		REQUEST
- *				(NEXT_SERVER_IP can be a relay itself)
- *	FIRST_RELAY_IP : 67 <- DHCP_SERVER_IP : 67	ACK
- *	CLIENT_IP : 68 <- FIRST_RELAY_IP : 67		ACK
- *
  * Note: NACK are broadcasted, rest is unicast, unless client asked
  * for a broadcast
  */
-
-
 #include <freeradius-devel/radiusd.h>
-#include <freeradius-devel/modules.h>
-#include <freeradius-devel/protocol.h>
-#include <freeradius-devel/process.h>
-#include <freeradius-devel/dhcpv4/dhcpv4.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/io/application.h>
 #include <freeradius-devel/rad_assert.h>
+#include "proto_dhcpv4.h"
 
-#ifndef __MINGW32__
-#  include <sys/ioctl.h>
-#endif
+extern fr_app_t proto_dhcpv4;
+static int transport_parse(TALLOC_CTX *ctx, void *out, CONF_ITEM *ci, CONF_PARSER const *rule);
 
-/*
- *	Same contents as listen_socket_t.
+/** How to parse a DHCPv4 listen section
+ *
  */
-typedef struct dhcp_socket_t {
-	listen_socket_t	lsock;
+static CONF_PARSER const proto_dhcpv4_config[] = {
+	{ FR_CONF_OFFSET("type", FR_TYPE_STRING | FR_TYPE_MULTI | FR_TYPE_NOT_EMPTY, proto_dhcpv4_t,
+			  types), .dflt = "DHCP-Discover" },
+	{ FR_CONF_OFFSET("transport", FR_TYPE_VOID, proto_dhcpv4_t, io_submodule),
+	  .func = transport_parse },
 
 	/*
-	 *	DHCP-specific additions.
+	 *	For performance tweaking.  NOT for normal humans.
 	 */
-	bool		suppress_responses;
-	RADCLIENT	dhcp_client;
-	char const	*src_interface;
-	fr_ipaddr_t	src_ipaddr;
-} dhcp_socket_t;
+	{ FR_CONF_OFFSET("default_message_size", FR_TYPE_UINT32, proto_dhcpv4_t, default_message_size) } ,
+	{ FR_CONF_OFFSET("num_messages", FR_TYPE_UINT32, proto_dhcpv4_t, num_messages) } ,
 
-static void dhcp_packet_debug(REQUEST *request, RADIUS_PACKET *packet, bool received);
+	CONF_PARSER_TERMINATOR
+};
 
-#ifdef WITH_UDPFROMTO
-static int dhcprelay_process_client_request(REQUEST *request)
+/** Wrapper around dl_instance
+ *
+ * @param[in] ctx	to allocate data in (instance of proto_dhcpv4).
+ * @param[out] out	Where to write a dl_instance_t containing the module handle and instance.
+ * @param[in] ci	#CONF_PAIR specifying the name of the type module.
+ * @param[in] rule	unused.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int transport_parse(TALLOC_CTX *ctx, void *out, CONF_ITEM *ci, UNUSED CONF_PARSER const *rule)
 {
-	uint8_t		maxhops = 16;
-	VALUE_PAIR	*vp, *giaddr;
-	dhcp_socket_t	*sock;
-
-	rad_assert(request->packet->data[0] == 1);
-
-	/*
-	 *	Do the forward by ourselves, do not rely on dhcp_socket_send()
-	 */
-	request->reply->code = 0;
-
-	/*
-	 * It's invalid to have giaddr=0 AND a relay option
-	 */
-	giaddr = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 266, TAG_ANY); /* DHCP-Gateway-IP-Address */
-	if (giaddr && (giaddr->vp_ipv4addr == htonl(INADDR_ANY)) &&
-			fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 82, TAG_ANY)) { /* DHCP-Relay-Agent-Information */
-		RDEBUG2("Received packet with giaddr = 0 and containing relay option: Discarding packet");
-		return 1;
-	}
-
-	/*
-	 * RFC 1542 (BOOTP), page 15
-	 *
-	 * Drop requests if hop-count > 16 or admin specified another value
-	 */
-	if ((vp = fr_pair_find_by_num(request->control, DHCP_MAGIC_VENDOR, 271, TAG_ANY))) { /* DHCP-Relay-Max-Hop-Count */
-	    maxhops = vp->vp_uint32;
-	}
-	vp = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 259, TAG_ANY); /* DHCP-Hop-Count */
-	rad_assert(vp != NULL);
-	if (vp->vp_uint8 > maxhops) {
-		RDEBUG2("Number of hops is greater than %d: not relaying", maxhops);
-		return 1;
-	} else {
-	    /* Increment hop count */
-	    vp->vp_uint8++;
-	}
-
-	sock = request->listener->data;
-
-	/*
-	 *	Forward the request to the next server using the
-	 *	incoming request as a template.
-	 */
-	/* set SRC ipaddr/port to the listener ipaddr/port */
-	request->packet->src_ipaddr.af = AF_INET;
-	request->packet->src_ipaddr.addr.v4.s_addr = sock->lsock.my_ipaddr.addr.v4.s_addr;
-	request->packet->src_port = sock->lsock.my_port;
+	char const	*name = cf_pair_value(cf_item_to_pair(ci));
+	dl_instance_t	*parent_inst;
+	CONF_SECTION	*listen_cs = cf_item_to_section(cf_parent(ci));
+	CONF_SECTION	*transport_cs;
 
-	vp = fr_pair_find_by_num(request->control, DHCP_MAGIC_VENDOR, 270, TAG_ANY); /* DHCP-Relay-To-IP-Address */
-	rad_assert(vp != NULL);
-
-	/* set DEST ipaddr/port to the next server ipaddr/port */
-	request->packet->dst_ipaddr.af = AF_INET;
-	request->packet->dst_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
-	request->packet->dst_port = sock->lsock.my_port;
+	transport_cs = cf_section_find(listen_cs, name, NULL);
 
 	/*
-	 *	Relaying is not proxying, we just forward it on and forget
-	 *	about it, not sending a response to the DHCP client.
+	 *	Allocate an empty section if one doesn't exist
+	 *	this is so defaults get parsed.
 	 */
-	dhcp_packet_debug(request, request->packet, false);
+	if (!transport_cs) transport_cs = cf_section_alloc(listen_cs, listen_cs, name, NULL);
 
-	if (fr_dhcpv4_packet_encode(request->packet) < 0) {
-		RPERROR("Failed encoding DHCP packet");
-		return -1;
-	}
+	parent_inst = cf_data_value(cf_data_find(listen_cs, dl_instance_t, "proto_dhcpv4"));
+	rad_assert(parent_inst);
 
-	return fr_dhcpv4_udp_packet_send(request->packet);
+	return dl_instance(ctx, out, transport_cs, parent_inst, name, DL_TYPE_SUBMODULE);
 }
 
-
-/*
- *	We've seen a reply from a server.
- *	i.e. we're a relay.
+/** Decode the packet.
+ *
+ *  The transport fills in the addresses, and points the packet at
+ *  the DHCP data.  We then decode the DHCP data into attributes.
  */
-static int dhcprelay_process_server_reply(REQUEST *request)
+static int mod_decode(void const *instance, REQUEST *request, uint8_t *const data, size_t data_len)
 {
-	VALUE_PAIR *vp, *giaddr;
-	dhcp_socket_t *sock;
+	proto_dhcpv4_t const	*inst = talloc_get_type_abort(instance, proto_dhcpv4_t);
+	RADIUS_PACKET		*packet = request->packet;
+	uint8_t			code;
+	int			xid;
+	size_t			hlen;
 
-	rad_assert(request->packet->data[0] == 2);
+	if (inst->app_io->decode(inst->app_io_instance, request, data, data_len) < 0) return -1;
 
 	/*
-	 * Do the forward by ourselves, do not rely on dhcp_socket_send()
+	 *	The transport has already checked the packet.  This
+	 *	just gets the message type and transaction ID.
 	 */
-	request->reply->code = 0;
-
-	sock = request->listener->data;
-
-	/*
-	 * Check that packet is for us.
-	 */
-	giaddr = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 266, TAG_ANY); /* DHCP-Gateway-IP-Address */
-
-	/* --with-udpfromto is needed just for the following test */
-	if (!giaddr || giaddr->vp_ipv4addr != request->packet->dst_ipaddr.addr.v4.s_addr) {
-		RDEBUG2("Packet received from server was not for us (was for 0x%x). Discarding packet",
-			ntohl(request->packet->dst_ipaddr.addr.v4.s_addr));
-		return 1;
+	if (!fr_dhcpv4_ok(packet->data, packet->data_len, &code, &xid)) {
+		RDEBUG("Failed decoding packet: %s", fr_strerror());
+		return -1;
 	}
 
-	/* set SRC ipaddr/port to the listener ipaddr/port */
-	request->packet->src_ipaddr.af = AF_INET;
-	request->packet->src_port = sock->lsock.my_port;
-
-	/* set DEST ipaddr/port to clientip/68 or broadcast in specific cases */
-	request->packet->dst_ipaddr.af = AF_INET;
+	packet->code = code | FR_DHCPV4_OFFSET;
+	packet->id = xid;
+	request->reply->id = xid;
 
 	/*
-	 *	We're a relay, and send the reply to giaddr.
+	 *	Create a unique vector from the MAC address and the
+	 *	DHCP opcode.  This is a hack for the RADIUS
+	 *	infrastructure in the rest of the server.
 	 */
-	request->reply->dst_ipaddr.addr.v4.s_addr = giaddr->vp_ipv4addr;
-	request->reply->dst_port = request->packet->dst_port;		/* server port */
-
-	if ((request->packet->code == FR_DHCPV4_NAK) ||
-	    !sock->src_interface ||
-	    ((vp = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 262, TAG_ANY)) /* DHCP-Flags */ &&
-	     (vp->vp_uint32 & 0x8000) &&
-	     ((vp = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 263, TAG_ANY)) /* DHCP-Client-IP-Address */ &&
-	      (vp->vp_ipv4addr == htonl(INADDR_ANY))))) {
-		/*
-		 * RFC 2131, page 23
-		 *
-		 * Broadcast on
-		 * - DHCPNAK
-		 * or
-		 * - Broadcast flag is set up and ciaddr == NULL
-		 */
-		RDEBUG2("Response will be broadcast");
-		request->packet->dst_ipaddr.addr.v4.s_addr = htonl(INADDR_BROADCAST);
-	} else {
-		/*
-		 * RFC 2131, page 23
-		 *
-		 * Unicast to
-		 * - ciaddr if present
-		 * otherwise to yiaddr
-		 */
-		if ((vp = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 263, TAG_ANY)) /* DHCP-Client-IP-Address */ &&
-		    (vp->vp_ipv4addr != htonl(INADDR_ANY))) {
-			request->packet->dst_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
-		} else {
-			vp = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 264, TAG_ANY); /* DHCP-Your-IP-Address */
-			if (!vp) {
-				RPEDEBUG("Failed to find IP Address for request");
-				return -1;
-			}
-
-			RDEBUG2("Response will be unicast to &DHCP-Your-IP-Address");
-			request->packet->dst_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
-
-			/*
-			 * When sending a DHCP_OFFER, make sure our ARP table
-			 * contains an entry for the client IP address, or else
-			 * packet may not be forwarded if it was the first time
-			 * the client was requesting an IP address.
-			 */
-			if (request->packet->code == FR_DHCPV4_OFFER) {
-				VALUE_PAIR *hwvp = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 267,
-								       TAG_ANY); /* DHCP-Client-Hardware-Address */
-				if (hwvp == NULL) {
-					RDEBUG2("DHCP_OFFER packet received with no Client Hardware Address. "
-						"Discarding packet");
-					return 1;
-				}
-				if (fr_dhcpv4_udp_add_arp_entry(request->packet->sockfd, sock->src_interface,
-								&vp->vp_ip, hwvp->vp_ether) < 0) {
-					REDEBUG("Failed adding ARP entry");
-					return -1;
-				}
-			}
-		}
-	}
+	hlen = packet->data[2];
+	memset(packet->vector, 0, sizeof(packet->vector));
+	memcpy(packet->vector, packet->data + 28, hlen);
+	packet->vector[hlen] = packet->code & 0xff;
 
 	/*
-	 *	Our response doesn't go through process.c
+	 *	The worker holds the message until it's done with the
+	 *	request, so we can decode straight out of it.
 	 */
-	dhcp_packet_debug(request, request->packet, false);
+	if (!request->async->message) {
+		packet->data = talloc_memdup(packet, packet->data, packet->data_len);
+		if (!packet->data) return -1;
+	}
 
-	if (fr_dhcpv4_packet_encode(request->packet) < 0) {
-		RPERROR("Failed encoding DHCP packet");
+	if (fr_dhcpv4_packet_decode(packet) < 0) {
+		RDEBUG("Failed decoding packet: %s", fr_strerror());
 		return -1;
 	}
 
-	return fr_dhcpv4_udp_packet_send(request->packet);
-}
-#else  /* WITH_UDPFROMTO */
-static int dhcprelay_process_server_reply(UNUSED REQUEST *request)
-{
-	WARN("DHCP Relaying requires the server to be configured with UDPFROMTO");
-	return -1;
-}
-
-static int dhcprelay_process_client_request(UNUSED REQUEST *request)
-{
-	WARN("DHCP Relaying requires the server to be configured with UDPFROMTO");
-	return -1;
+	return 0;
 }
 
-#endif	/* WITH_UDPFROMTO */
-
-static const uint32_t attrnums[] = {
-	57,	/* DHCP-DHCP-Maximum-Msg-Size */
-	256,	/* DHCP-Opcode */
-	257,	/* DHCP-Hardware-Type */
-	258,	/* DHCP-Hardware-Address-Length */
-	259,	/* DHCP-Hop-Count */
-	260,	/* DHCP-Transaction-Id */
-	262,	/* DHCP-Flags */
-	263,	/* DHCP-Client-IP-Address */
-	266,	/* DHCP-Gateway-IP-Address */
-	267	/* DHCP-Client-Hardware-Address */
-};
-
-static rlm_rcode_t dhcp_process(REQUEST *request)
+static ssize_t mod_encode(void const *instance, REQUEST *request, uint8_t *buffer, size_t buffer_len)
 {
-	rlm_rcode_t	rcode;
-	unsigned int	i;
-	VALUE_PAIR	*vp;
-	dhcp_socket_t	*sock;
-
-	/*
-	 *	If there's a giaddr, save it as the Relay-IP-Address
-	 *	in the response.  That way the later code knows where
-	 *	to send the reply.
-	 */
-	vp = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 266, TAG_ANY); /* DHCP-Gateway-IP-Address */
-	if (vp && (vp->vp_ipv4addr != htonl(INADDR_ANY))) {
-		VALUE_PAIR *relay;
-
-		/* DHCP-Relay-IP-Address */
-		relay = radius_pair_create(request->reply, &request->reply->vps,
-					  272, DHCP_MAGIC_VENDOR);
-		if (relay) relay->vp_ipv4addr = vp->vp_ipv4addr;
-	}
+	proto_dhcpv4_t const *inst = talloc_get_type_abort(instance, proto_dhcpv4_t);
 
-	vp = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 53, TAG_ANY); /* DHCP-Message-Type */
-	if (vp) {
-		fr_dict_enum_t *dv = fr_dict_enum_by_value(NULL, vp->da, &vp->data);
-
-		if (dv) {
-			CONF_SECTION *server, *unlang;
-
-			RDEBUG("Trying sub-section dhcp %s {...}", dv->alias);
-
-			server = cf_item_to_section(cf_parent(request->listener->cs));
-
-			unlang = cf_section_find(server, "dhcp", dv->alias);
-			rcode = unlang_interpret(request, unlang, RLM_MODULE_NOOP);
-		} else {
-			REDEBUG("Unknown DHCP-Message-Type %d", vp->vp_uint8);
-			rcode = RLM_MODULE_FAIL;
-		}
-	} else {
-		REDEBUG("Failed to find DHCP-Message-Type in packet!");
-		rcode = RLM_MODULE_FAIL;
-	}
-
-	vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 53, TAG_ANY); /* DHCP-Message-Type */
-	if (vp) {
-		request->reply->code = vp->vp_uint8;
-		if ((request->reply->code != 0) &&
-		    (request->reply->code < FR_DHCPV4_OFFSET)) {
-			request->reply->code += FR_DHCPV4_OFFSET;
-		}
-	}
-	else switch (rcode) {
-	case RLM_MODULE_OK:
-	case RLM_MODULE_UPDATED:
-		if (request->packet->code == FR_DHCPV4_DISCOVER) {
-			request->reply->code = FR_DHCPV4_OFFER;
-			break;
-
-		} else if (request->packet->code == FR_DHCPV4_REQUEST) {
-			request->reply->code = FR_DHCPV4_ACK;
-			break;
-		}
-		request->reply->code = FR_DHCPV4_NAK;
-		break;
-
-	default:
-	case RLM_MODULE_REJECT:
-	case RLM_MODULE_FAIL:
-	case RLM_MODULE_INVALID:
-	case RLM_MODULE_NOOP:
-	case RLM_MODULE_NOTFOUND:
-		if (request->packet->code == FR_DHCPV4_DISCOVER) {
-			request->reply->code = 0; /* ignore the packet */
-		} else {
-			request->reply->code = FR_DHCPV4_NAK;
-		}
-		break;
-
-	case RLM_MODULE_HANDLED:
-		request->reply->code = 0; /* ignore the packet */
-		break;
+	if (fr_dhcpv4_packet_encode(request->reply) < 0) {
+		RDEBUG("Failed encoding DHCP reply: %s", fr_strerror());
+		return -1;
 	}
 
 	/*
-	 *	TODO: Handle 'output' of RLM_MODULE when acting as a
-	 *	DHCP relay We may want to not forward packets in
-	 *	certain circumstances.
-	 */
-
-	/*
-	 * 	Handle requests when acting as a DHCP relay
+	 *	Let the app_io add whatever it needs to send the reply.
 	 */
-	vp = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 256, TAG_ANY); /* DHCP-Opcode */
-	if (!vp) {
-		RPEDEBUG("Someone deleted the DHCP-Opcode!");
-		return RLM_MODULE_FAIL;
-	}
-
-	/* BOOTREPLY received on port 67 (i.e. from a server) */
-	if (vp->vp_uint8 == 2) {
-		return dhcprelay_process_server_reply(request);
-	}
-
-	/* Packet from client, and we have DHCP-Relay-To-IP-Address */
-	if (fr_pair_find_by_num(request->control, DHCP_MAGIC_VENDOR, 270, TAG_ANY)) {
-		return dhcprelay_process_client_request(request);
-	}
+	return inst->app_io->encode(inst->app_io_instance, request, buffer, buffer_len);
+}
 
-	/* else it's a packet from a client, without relaying */
-	rad_assert(vp->vp_uint8 == 1); /* BOOTREQUEST */
+static void mod_process_set(void const *instance, REQUEST *request)
+{
+	proto_dhcpv4_t const *inst = talloc_get_type_abort(instance, proto_dhcpv4_t);
+	fr_io_process_t process;
 
-	sock = request->listener->data;
+	rad_assert(request->packet->code > FR_DHCPV4_OFFSET);
+	rad_assert(request->packet->code < FR_DHCPV4_MAX);
 
-	/*
-	 *	Handle requests when acting as a DHCP server
-	 */
+	request->server_cs = inst->server_cs;
 
-	/*
-	 *	Releases don't get replies.
-	 */
-	if (request->packet->code == FR_DHCPV4_RELEASE) {
-		request->reply->code = 0;
+	process = inst->process;
+	if (!process) {
+		REDEBUG("No module available to handle packet code %i", request->packet->code);
+		return;
 	}
 
-	if (request->reply->code == 0) {
-		return RLM_MODULE_OK;
-	}
+	request->async->process = process;
+}
 
-	request->reply->sockfd = request->packet->sockfd;
+/** Open listen sockets/connect to external event source
+ *
+ * @param[in] instance	Ctx data for this application.
+ * @param[in] sc	to add our file descriptor to.
+ * @param[in] conf	Listen section parsed to give us isntance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_open(void *instance, fr_schedule_t *sc, CONF_SECTION *conf)
+{
+	fr_listen_t	*listen;
+	proto_dhcpv4_t 	*inst = talloc_get_type_abort(instance, proto_dhcpv4_t);
 
 	/*
-	 *	Copy specific fields from packet to reply, if they
-	 *	don't already exist
+	 *	Build the #fr_listen_t.  This describes the complete
+	 *	path, data takes from the socket to the decoder and
+	 *	back again.
 	 */
-	for (i = 0; i < sizeof(attrnums) / sizeof(attrnums[0]); i++) {
-		uint32_t attr = attrnums[i];
-
-		if (fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, attr, TAG_ANY)) continue;
+	listen = talloc_zero(inst, fr_listen_t);
 
-		vp = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, attr, TAG_ANY);
-		if (vp) {
-			fr_pair_add(&request->reply->vps, fr_pair_copy(request->reply, vp));
-		}
-	}
+	listen->app_io = inst->app_io;
+	listen->app_io_instance = inst->app_io_instance;
 
-	vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 256, TAG_ANY); /* DHCP-Opcode */
-	rad_assert(vp != NULL);
-	vp->vp_uint8 = 2; /* BOOTREPLY */
+	listen->app = &proto_dhcpv4;
+	listen->app_instance = instance;
+	listen->server_cs = inst->server_cs;
 
 	/*
-	 *	Allow NAKs to be delayed for a short period of time.
+	 *	Set configurable parameters for message ring buffer.
 	 */
-	if (request->reply->code == FR_DHCPV4_NAK) {
-		vp = fr_pair_find_by_num(request->reply->vps, 0, FR_FREERADIUS_RESPONSE_DELAY, TAG_ANY);
-		if (vp) {
-			if (vp->vp_uint32 <= 10) {
-				request->response_delay.tv_sec = vp->vp_uint32;
-				request->response_delay.tv_usec = 0;
-			} else {
-				request->response_delay.tv_sec = 10;
-				request->response_delay.tv_usec = 0;
-			}
-		} else {
-#ifndef USEC
-#define USEC 1000000
-#endif
-			vp = fr_pair_find_by_num(request->reply->vps, 0, FR_FREERADIUS_RESPONSE_DELAY_USEC, TAG_ANY);
-			if (vp) {
-				if (vp->vp_uint32 <= 10 * USEC) {
-					request->response_delay.tv_sec = vp->vp_uint32 / USEC;
-					request->response_delay.tv_usec = vp->vp_uint32 % USEC;
-				} else {
-					request->response_delay.tv_sec = 10;
-					request->response_delay.tv_usec = 0;
-				}
-			}
-		}
-	}
+	listen->default_message_size = inst->default_message_size;
+	listen->num_messages = inst->num_messages;
 
 	/*
-	 *	Prepare the reply packet for sending through dhcp_socket_send()
-	 */
-	request->reply->dst_ipaddr.af = AF_INET;
-	request->reply->src_ipaddr.af = AF_INET;
-	request->reply->src_ipaddr.prefix = 32;
-
-	/*
-	 *	Packet-Src-IP-Address has highest precedence
-	 */
-	vp = fr_pair_find_by_num(request->reply->vps, 0, FR_PACKET_SRC_IP_ADDRESS, TAG_ANY);
-	if (vp) {
-		request->reply->if_index = 0;	/* Must be 0, we don't know the outbound if_index */
-		request->reply->src_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
-	/*
-	 *	The request was unicast (via a relay)
-	 */
-	} else if (request->packet->dst_ipaddr.addr.v4.s_addr != htonl(INADDR_BROADCAST) &&
-		   request->packet->dst_ipaddr.addr.v4.s_addr != htonl(INADDR_ANY)) {
-		request->reply->src_ipaddr.addr.v4.s_addr = request->packet->dst_ipaddr.addr.v4.s_addr;
-		request->reply->if_index = request->packet->if_index;
-	/*
-	 *	The listener was bound to an IP address, or we determined
-	 *	the address automatically, as it was the only address bound
-	 *	to the interface, and we bound to the interface.
+	 *	Open the socket, and add it to the scheduler.
 	 */
-	} else if (sock->src_ipaddr.addr.v4.s_addr != htonl(INADDR_ANY)) {
-		request->reply->src_ipaddr.addr.v4.s_addr = sock->src_ipaddr.addr.v4.s_addr;
-#ifdef WITH_IFINDEX_IPADDR_RESOLUTION
-	/*
-	 *	We built with udpfromto and have the if_index of the receiving
-	 *	interface, which we can now resolve to an IP address.
-	 */
-	} else if (request->packet->if_index > 0) {
-		fr_ipaddr_t primary;
+	if (inst->app_io) {
+		if (inst->app_io->open(inst->app_io_instance) < 0) {
+			cf_log_err(conf, "Failed opening %s interface", inst->app_io->name);
+			talloc_free(listen);
+			return -1;
+		}
 
-		if (fr_ipaddr_from_ifindex(&primary, request->packet->sockfd, request->packet->dst_ipaddr.af,
-					   request->packet->if_index) < 0) {
-			RPEDEBUG("Failed determining src_ipaddr from if_index");
-			return RLM_MODULE_FAIL;
+		if (!fr_schedule_socket_add(sc, listen)) {
+			talloc_free(listen);
+			return -1;
 		}
-		request->reply->src_ipaddr.addr.v4.s_addr = primary.addr.v4.s_addr;
-#endif
-	/*
-	 *	There's a Server-Identification attribute
-	 */
-	} else if ((vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 54, TAG_ANY))) {
-		request->reply->src_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
-	} else {
-		REDEBUG("Unable to determine correct src_ipaddr for response");
-		return RLM_MODULE_FAIL;
 	}
-	request->reply->dst_port = request->packet->src_port;
-	request->reply->src_port = request->packet->dst_port;
 
-	/*
-	 *	Answer to client's nearest DHCP relay.
-	 *
-	 *	Which may be different than the giaddr given in the
-	 *	packet to the client.  i.e. the relay may have a
-	 *	public IP, but the gateway a private one.
-	 */
-	vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 272, TAG_ANY); /* DHCP-Relay-IP-Address */
-	if (vp && (vp->vp_ipv4addr != ntohl(INADDR_ANY))) {
-		RDEBUG2("Reply will be unicast to giaddr from original packet");
-		request->reply->dst_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
-		request->reply->dst_port = request->packet->dst_port;
+	inst->listen = listen;	/* Probably won't need it, but doesn't hurt */
 
-		vp = fr_pair_find_by_num(request->reply->vps, 0, FR_PACKET_DST_PORT, TAG_ANY);
-		if (vp) request->reply->dst_port = vp->vp_uint32;
+	return 0;
+}
 
-		return RLM_MODULE_OK;
-	}
+/** Instantiate the application
+ *
+ * Instantiate I/O and type submodules.
+ *
+ * @param[in] instance	Ctx data for this application.
+ * @param[in] conf	Listen section parsed to give us isntance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	proto_dhcpv4_t		*inst = talloc_get_type_abort(instance, proto_dhcpv4_t);
+	fr_app_process_t const	*app_process;
 
 	/*
-	 *	Answer to client's nearest DHCP gateway.  In this
-	 *	case, the client can reach the gateway, as can the
-	 *	server.
-	 *
-	 *	We also use *our* source port as the destination port.
-	 *	Gateways are servers, and listen on the server port,
-	 *	not the client port.
+	 *	The listener is inside of a virtual server.
 	 */
-	vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 266, TAG_ANY); /* DHCP-Gateway-IP-Address */
-	if (vp && (vp->vp_ipv4addr != htonl(INADDR_ANY))) {
-		RDEBUG2("Reply will be unicast to giaddr");
-		request->reply->dst_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
-		request->reply->dst_port = request->packet->dst_port;
-		return RLM_MODULE_OK;
-	}
+	inst->server_cs = cf_item_to_section(cf_parent(conf));
 
 	/*
-	 *	If it's a NAK, or the broadcast flag was set, ond
-	 *	there's no client-ip-address, send a broadcast.
+	 *	Instantiate the I/O module
 	 */
-	if ((request->reply->code == FR_DHCPV4_NAK) ||
-	    ((vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 262, TAG_ANY)) && /* DHCP-Flags */
-	     (vp->vp_uint32 & 0x8000) &&
-	     ((vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 263, TAG_ANY)) && /* DHCP-Client-IP-Address */
-	      (vp->vp_ipv4addr == htonl(INADDR_ANY))))) {
-		/*
-		 * RFC 2131, page 23
-		 *
-		 * Broadcast on
-		 * - DHCPNAK
-		 * or
-		 * - Broadcast flag is set up and ciaddr == NULL
-		 */
-		RDEBUG2("Reply will be broadcast");
-		request->reply->dst_ipaddr.addr.v4.s_addr = htonl(INADDR_BROADCAST);
-		return RLM_MODULE_OK;
+	if (inst->app_io && inst->app_io->instantiate &&
+	    (inst->app_io->instantiate(inst->app_io_instance,
+				       inst->app_io_conf) < 0)) {
+		cf_log_err(conf, "Instantiation failed for \"%s\"", inst->app_io->name);
+		return -1;
 	}
 
 	/*
-	 *	RFC 2131, page 23
-	 *
-	 *	Unicast to ciaddr if present, otherwise to yiaddr.
+	 *	Instantiate the process module
 	 */
-	if ((vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 263, TAG_ANY)) && /* DHCP-Client-IP-Address */
-	    (vp->vp_ipv4addr != htonl(INADDR_ANY))) {
-		RDEBUG2("Reply will be sent unicast to &DHCP-Client-IP-Address");
-		request->reply->dst_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
-		return RLM_MODULE_OK;
+	app_process = (fr_app_process_t const *)inst->process_submodule->module->common;
+	if (app_process->instantiate && (app_process->instantiate(inst->process_submodule->data,
+								  inst->process_submodule->conf) < 0)) {
+		cf_log_err(conf, "Instantiation failed for \"%s\"", app_process->name);
+		return -1;
 	}
 
-	vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 264, TAG_ANY); /* DHCP-Your-IP-Address */
-	if (!vp) {
-		REDEBUG("Can't assign address to client: Neither &reply:DHCP-Client-IP-Address nor "
-			"&reply:DHCP-Your-IP-Address set");
-		/*
-		 *	There is nowhere to send the response to, so don't bother.
-		 */
-		request->reply->code = 0;
-		return RLM_MODULE_FAIL;
-	}
+	inst->process = app_process->process;	/* Store the process function */
 
-#ifdef SIOCSARP
 	/*
-	 *	The system is configured to listen for broadcast
-	 *	packets, which means we'll need to send unicast
-	 *	replies, to IPs which haven't yet been assigned.
-	 *	Therefore, we need to update the ARP table.
-	 *
-	 *	However, they haven't specified a interface.  So we
-	 *	can't update the ARP table.  And we must send a
-	 *	broadcast response.
+	 *	These configuration items are not printed by default,
+	 *	because normal people shouldn't be touching them.
 	 */
-	if (sock->lsock.broadcast && !sock->src_interface) {
-		WARN("You MUST set \"interface\" if you have \"broadcast = yes\"");
-		RDEBUG2("Reply will be broadcast as no interface was defined");
-		request->reply->dst_ipaddr.addr.v4.s_addr = htonl(INADDR_BROADCAST);
-		return RLM_MODULE_OK;
-	}
+	if (!inst->default_message_size && inst->app_io) inst->default_message_size = inst->app_io->default_message_size;
 
-	RDEBUG2("Reply will be unicast to &DHCP-Your-IP-Address");
-	request->reply->dst_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
+	if (!inst->num_messages) inst->num_messages = 256;
 
-	/*
-	 *	When sending a DHCP_OFFER, make sure our ARP table
-	 *	contains an entry for the client IP address.
-	 *	Otherwise the packet may not be sent to the client, as
-	 *	the OS has no ARP entry for it.
-	 *
-	 *	This is a cute hack to avoid us having to create a raw
-	 *	socket to send DHCP packets.
-	 */
-	if (request->reply->code == FR_DHCPV4_OFFER) {
-		VALUE_PAIR *hwvp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 267, TAG_ANY); /* DHCP-Client-Hardware-Address */
-
-		if (!hwvp) return RLM_MODULE_FAIL;
+	FR_INTEGER_BOUND_CHECK("num_messages", inst->num_messages, >=, 32);
+	FR_INTEGER_BOUND_CHECK("num_messages", inst->num_messages, <=, 65535);
 
-		if (fr_dhcpv4_udp_add_arp_entry(request->reply->sockfd, sock->src_interface,
-						&vp->vp_ip, hwvp->vp_ether) < 0) {
-			RPEDEBUG("Failed adding arp entry");
-			return RLM_MODULE_FAIL;
-		}
-	}
-#else
-	if (request->packet->src_ipaddr.addr.v4.s_addr != ntohl(INADDR_NONE)) {
-		RDEBUG2("Reply will be unicast to the unicast source IP address");
-		request->reply->dst_ipaddr.addr.v4.s_addr = request->packet->src_ipaddr.addr.v4.s_addr;
-	} else {
-		RDEBUG2("Reply will be broadcast as this system does not support ARP updates");
-		request->reply->dst_ipaddr.addr.v4.s_addr = htonl(INADDR_BROADCAST);
-	}
-#endif
+	FR_INTEGER_BOUND_CHECK("default_message_size", inst->default_message_size, >=, 1024);
+	FR_INTEGER_BOUND_CHECK("default_message_size", inst->default_message_size, <=, 65535);
 
-	return RLM_MODULE_OK;
+	return 0;
 }
 
-/*
- *	We allow using PCAP, but only if there's no SO_BINDTODEVICE
- */
-#ifndef SO_BINDTODEVICE
-#ifdef HAVE_PCAP_H
-#define PCAP_RAW_SOCKETS (1)
-#endif
-#endif
-
-#ifdef PCAP_RAW_SOCKETS
-/** Build PCAP filter string to pass to libpcap based on listen section
- * Will be called by init_pcap.
+/** Bootstrap the application
+ *
+ * Bootstrap I/O and type submodules.
  *
- * @param this listen section
- * @return PCAP filter string
+ * @param[in] instance	Ctx data for this application.
+ * @param[in] conf	Listen section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static const char *dhcp_pcap_filter_build(rad_listen_t *this)
+static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
-	dhcp_socket_t	*sock = this->data;
-	char		*filter;
+	proto_dhcpv4_t 		*inst = talloc_get_type_abort(instance, proto_dhcpv4_t);
+	size_t			i;
+	fr_dict_attr_t const	*da;
+	dl_instance_t		*parent_inst;
+	fr_app_process_t const	*app_process;
 
 	/*
-	 *	Set the port filter
+	 *	Needed to populate the code array
 	 */
-	filter = talloc_strdup(this, "(udp and dst port ");
-	if (sock->lsock.my_port) {
-		filter = talloc_asprintf_append_buffer(filter, "%u)", sock->lsock.my_port);
-	} else {
-		filter = talloc_strdup_append_buffer(filter, "bootps)");
+	da = fr_dict_attr_by_num(NULL, DHCP_MAGIC_VENDOR, FR_DHCPV4_MESSAGE_TYPE);
+	if (!da) {
+		ERROR("Missing definiton for DHCP-Message-Type");
+		return -1;
 	}
 
-	if (!fr_ipaddr_is_inaddr_any(&sock->lsock.my_ipaddr)) {
-		char buffer[INET_ADDRSTRLEN];
-		fr_inet_ntoh(&sock->lsock.my_ipaddr, buffer, sizeof(buffer));
+	for (i = 0; i < talloc_array_length(inst->types); i++) {
+		fr_dict_enum_t const	*type_enum;
+		uint8_t			code;
 
-		if (sock->lsock.broadcast) {
-			filter = talloc_asprintf_append_buffer(filter, " and (dst host %s or dst host 255.255.255.255)",
-							       buffer);
-		} else {
-			filter = talloc_asprintf_append_buffer(filter, " and dst host %s", buffer);
+		type_enum = fr_dict_enum_by_alias(NULL, da, inst->types[i]);
+		if (!type_enum) {
+			cf_log_err(conf, "Invalid type \"%s\"", inst->types[i]);
+			return -1;
 		}
-	}
-
-	return filter;
-}
-#endif
-
-static int dhcp_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
-{
-	int rcode;
-	dhcp_socket_t *sock = this->data;
-	RADCLIENT *client;
-	CONF_PAIR *cp;
-
-#ifdef PCAP_RAW_SOCKETS
-	sock->lsock.pcap_filter_builder = dhcp_pcap_filter_build;
-	sock->lsock.pcap_type = PCAP_INTERFACE_IN_OUT;
-#endif
 
-	/*
-	 *	Set if before parsing, so the user can forcibly turn
-	 *	it off later.
-	 */
-	this->nodup = true;
-
-	rcode = common_socket_parse(cs, this);
-	if (rcode != 0) return rcode;
-
-	if (!sock->lsock.interface) WARN("No \"interface\" setting is defined.  Only unicast DHCP will work");
-
-	/*
-	 *	Undocumented extension for testing without
-	 *	destroying your network!
-	 */
-	sock->suppress_responses = false;
-	cp = cf_pair_find(cs, "suppress_responses");
-	if (cp) {
-		rcode = cf_pair_parse(sock, cs, "suppress_responses",
-				      FR_ITEM_POINTER(FR_TYPE_BOOL, &sock->suppress_responses), NULL, T_INVALID);
-		if (rcode < 0) return -1;
-	}
-
-	cp = cf_pair_find(cs, "src_interface");
-	if (cp) {
-		rcode = cf_pair_parse(sock, cs, "src_interface",
-				      FR_ITEM_POINTER(FR_TYPE_STRING, &sock->src_interface), NULL, T_INVALID);
-		if (rcode < 0) return -1;
-	} else {
-		sock->src_interface = sock->lsock.interface;
-	}
-
-	if (!sock->src_interface && sock->lsock.interface) {
-		sock->src_interface = talloc_typed_strdup(sock, sock->lsock.interface);
-	}
-
-	/*
-	 *	Set the source IP address explicitly.
-	 */
-	cp = cf_pair_find(cs, "src_ipaddr");
-	if (cp) {
-		memset(&sock->src_ipaddr, 0, sizeof(sock->src_ipaddr));
-		sock->src_ipaddr.addr.v4.s_addr = htonl(INADDR_NONE);
-		rcode = cf_pair_parse(sock, cs, "src_ipaddr",
-				      FR_ITEM_POINTER(FR_TYPE_IPV4_ADDR, &sock->src_ipaddr), NULL, T_INVALID);
-		if (rcode < 0) return -1;
-
-		sock->src_ipaddr.af = AF_INET;
-	/*
-	 *	Or by looking up the IP address associated with the
-	 *	src_interface or interface (if we're binding to INADDR_ANY).
-	 */
-	} else {
-		char buffer[INET_ADDRSTRLEN];
-
-		if (fr_ipaddr_is_inaddr_any(&sock->lsock.my_ipaddr) && sock->src_interface) {
-			if (fr_ipaddr_from_ifname(&sock->src_ipaddr, AF_INET, sock->src_interface) < 0) {
-				WARN("Failed resolving interface %s to IP address: %s", sock->src_interface,
-				     fr_strerror());
-				WARN("Will continue, but source address must be set within the DHCP virtual server");
-				goto src_addr_is_bound_addr;
-			}
-			inet_ntop(sock->src_ipaddr.af, &sock->src_ipaddr.addr.v4.s_addr, buffer, sizeof(buffer));
-			rad_assert(sock->src_ipaddr.af == AF_INET);
-		} else {
-		src_addr_is_bound_addr:
-			sock->src_ipaddr = sock->lsock.my_ipaddr;
+		code = type_enum->value->vb_uint8;
+		if ((code == 0) || ((code | FR_DHCPV4_OFFSET) >= FR_DHCPV4_MAX)) {
+			cf_log_err(conf, "Cannot listen for DHCP-Message-Type = '%s'", inst->types[i]);
+			return -1;
 		}
 
-		/*
-		 *	If src is not INADDR_ANY add a configuration item
-		 */
-		if (!fr_ipaddr_is_inaddr_any(&sock->src_ipaddr)) {
-			/*
-			 *	Magic defaults FTW.
-			 *
-			 *	This lets %{config:} work as expected, if we want to set
-			 *	DHCP-DHCP-Server-Identifier.
-			 */
-			inet_ntop(sock->src_ipaddr.af, &sock->src_ipaddr.addr.v4.s_addr, buffer, sizeof(buffer));
-			DEBUG2("\tsrc_ipaddr = \"%s\"", buffer);
-			cp = cf_pair_alloc(cs, "src_ipaddr", buffer, T_OP_SET, T_BARE_WORD, T_BARE_WORD);
-			if (!cp) return -1;
-			cf_pair_add(cs, cp);
-		}
+		inst->code_allowed[code] = true;
 	}
 
 	/*
-	 *	Initialize the fake client.
+	 *	All of the message types use the same process
+	 *	module, which looks up "recv <type>" sections.
+	 *
+	 *	Parent dl_instance_t added in virtual_servers.c (listen_parse)
 	 */
-	client = &sock->dhcp_client;
-	memset(client, 0, sizeof(*client));
-	client->ipaddr.af = AF_INET;
-	client->ipaddr.addr.v4.s_addr = ntohl(INADDR_NONE);
-	client->ipaddr.prefix = 0;
-	client->longname = client->shortname = "dhcp";
-	client->secret = client->shortname;
-	client->nas_type = talloc_typed_strdup(sock, "none");
-
-	return 0;
-}
-
-
-/*
- *	Check if an incoming request is "ok"
- *
- *	It takes packets, not requests.  It sees if the packet looks
- *	OK.  If so, it does a number of sanity checks on it.
- */
-static int dhcp_socket_recv(rad_listen_t *listener)
-{
-	RADIUS_PACKET	*packet;
-	dhcp_socket_t	*sock = listener->data;
-	RADCLIENT	*client = &sock->dhcp_client;
-
-	if (!rad_cond_assert(client != NULL)) return 1;
-
-	FR_STATS_INC(auth, total_requests);
-	FR_STATS_TYPE_INC(client->auth.total_requests);
-
-#ifdef PCAP_RAW_SOCKETS
-	if (sock->lsock.pcap) {
-		packet = fr_dhcpv4_pcap_recv(sock->lsock.pcap);
-	} else
-#endif
-	{
-		packet = fr_dhcpv4_udp_packet_recv(listener->fd);
-	}
+	parent_inst = cf_data_value(cf_data_find(conf, dl_instance_t, "proto_dhcpv4"));
+	rad_assert(parent_inst);
 
-	if (!packet) {
-		FR_STATS_INC(auth, total_malformed_requests);
-		ERROR("%s", fr_strerror());
-		return 0;
-	}
-
-	if (!request_receive(NULL, listener, packet, &sock->dhcp_client, dhcp_process)) {
-		FR_STATS_INC(auth, total_packets_dropped);
-		fr_radius_free(&packet);
-		return 0;
-	}
-
-	return 1;
-}
-
-
-/*
- *	Send an authentication response packet
- */
-static int dhcp_socket_send(rad_listen_t *listener, REQUEST *request)
-{
-	dhcp_socket_t	*sock = listener->data;
-
-	rad_assert(request->listener == listener);
-	rad_assert(listener->send == dhcp_socket_send);
-
-	if (request->reply->code == 0) return 0; /* don't reply */
-
-	if (fr_dhcpv4_packet_encode(request->reply) < 0) {
-		RPERROR("Failed encoding DHCP packet");
+	if (dl_instance(inst, &inst->process_submodule, conf, parent_inst, "base", DL_TYPE_SUBMODULE) < 0) {
+		cf_log_err(conf, "Failed loading process module: %s", fr_strerror());
 		return -1;
 	}
 
-	if (sock->suppress_responses) return 0;
-
-#ifdef PCAP_RAW_SOCKETS
-	if (sock->lsock.pcap) {
-		/* set ethernet destination address to DHCP-Client-Hardware-Address in request. */
-		uint8_t dhmac[ETHER_HDR_LEN] = { 0 };
-		VALUE_PAIR *vp;
-
-		vp = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 267, TAG_ANY);
-		if (vp) {
-			memcpy(dhmac, vp->vp_ether, sizeof(vp->vp_ether));
-		} else {
-			REDEBUG("&DHCP-Client-Hardware-Address not found in request");
-			return -1;
-		}
-
-		return fr_dhcpv4_pcap_send(sock->lsock.pcap, dhmac, request->reply);
-	} else
-#endif
-	{
-		return fr_dhcpv4_udp_packet_send(request->reply);
+	app_process = (fr_app_process_t const *)inst->process_submodule->module->common;
+	if (app_process->bootstrap && (app_process->bootstrap(inst->process_submodule->data,
+							      inst->process_submodule->conf) < 0)) {
+		cf_log_err(conf, "Bootstrap failed for \"%s\"", app_process->name);
+		return -1;
 	}
-}
 
-/*
- *	Debug the packet if requested.
- */
-static void dhcp_packet_debug(REQUEST *request, RADIUS_PACKET *packet, bool received)
-{
-	char src_ipaddr[INET6_ADDRSTRLEN];
-	char dst_ipaddr[INET6_ADDRSTRLEN];
-#if defined(WITH_UDPFROMTO) && defined(WITH_IFINDEX_NAME_RESOLUTION)
-	char if_name[IFNAMSIZ];
-#endif
-
-	if (!packet) return;
-	if (!RDEBUG_ENABLED) return;
+	/*
+	 *	No IO module, it's an empty listener.
+	 */
+	if (!inst->io_submodule) return 0;
 
 	/*
-	 *	Client-specific debugging re-prints the input
-	 *	packet into the client log.
-	 *
-	 *	This really belongs in a utility library
+	 *	Bootstrap the I/O module
 	 */
-	if ((packet->code > FR_DHCPV4_OFFSET) && (packet->code < FR_DHCPV4_MAX)) {
-		radlog_request(L_DBG, L_DBG_LVL_1, request, "%s %s Id %08x from %s%s%s:%i to %s%s%s:%i "
-#if defined(WITH_UDPFROMTO) && defined(WITH_IFINDEX_NAME_RESOLUTION)
-			       "%s%s%s"
-#endif
-			       "length %zu",
-			       received ? "Received" : "Sent",
-			       dhcp_message_types[packet->code - FR_DHCPV4_OFFSET],
-			       packet->id,
-			       packet->src_ipaddr.af == AF_INET6 ? "[" : "",
-			       inet_ntop(packet->src_ipaddr.af,
-					 &packet->src_ipaddr.addr,
-					 src_ipaddr, sizeof(src_ipaddr)),
-			       packet->src_ipaddr.af == AF_INET6 ? "]" : "",
-			       packet->src_port,
-			       packet->dst_ipaddr.af == AF_INET6 ? "[" : "",
-			       inet_ntop(packet->dst_ipaddr.af,
-					 &packet->dst_ipaddr.addr,
-					 dst_ipaddr, sizeof(dst_ipaddr)),
-			       packet->dst_ipaddr.af == AF_INET6 ? "]" : "",
-			       packet->dst_port,
-#if defined(WITH_UDPFROMTO) && defined(WITH_IFINDEX_NAME_RESOLUTION)
-			       packet->if_index ? "via " : "",
-			       packet->if_index ? fr_ifname_from_ifindex(if_name, packet->if_index) : "",
-			       packet->if_index ? " " : "",
-#endif
-			       packet->data_len);
-	} else {
-		radlog_request(L_DBG, L_DBG_LVL_1, request, "%s code %u Id %08x from %s%s%s:%i to %s%s%s:%i "
-#if defined(WITH_UDPFROMTO) && defined(WITH_IFINDEX_NAME_RESOLUTION)
-			       "%s%s%s"
-#endif
-			       "length %zu",
-			       received ? "Received" : "Sent",
-			       packet->code,
-			       packet->id,
-			       packet->src_ipaddr.af == AF_INET6 ? "[" : "",
-			       inet_ntop(packet->src_ipaddr.af,
-					 &packet->src_ipaddr.addr,
-					 src_ipaddr, sizeof(src_ipaddr)),
-			       packet->src_ipaddr.af == AF_INET6 ? "]" : "",
-			       packet->src_port,
-			       packet->dst_ipaddr.af == AF_INET6 ? "[" : "",
-			       inet_ntop(packet->dst_ipaddr.af,
-					 &packet->dst_ipaddr.addr,
-					 dst_ipaddr, sizeof(dst_ipaddr)),
-			       packet->dst_ipaddr.af == AF_INET6 ? "]" : "",
-			       packet->dst_port,
-#if defined(WITH_UDPFROMTO) && defined(WITH_IFINDEX_NAME_RESOLUTION)
-			       packet->if_index ? "via " : "",
-			       packet->if_index ? fr_ifname_from_ifindex(if_name, packet->if_index) : "",
-			       packet->if_index ? " " : "",
-#endif
-			       packet->data_len);
-	}
+	inst->app_io = (fr_app_io_t const *) inst->io_submodule->module->common;
+	inst->app_io_instance = inst->io_submodule->data;
+	inst->app_io_conf = inst->io_submodule->conf;
+	inst->app_io_private = dl_instance_symbol(dl_instance_find(inst->app_io_instance),
+						  "proto_dhcpv4_app_io_private");
+	rad_assert(inst->app_io_private);
 
-	if (received) {
-		rdebug_pair_list(L_DBG_LVL_2, request, packet->vps, NULL);
-	} else {
-		rdebug_proto_pair_list(L_DBG_LVL_2, request, packet->vps, NULL);
+	if (inst->app_io->bootstrap && (inst->app_io->bootstrap(inst->app_io_instance,
+								inst->app_io_conf) < 0)) {
+		cf_log_err(inst->app_io_conf, "Bootstrap failed for \"%s\"", inst->app_io->name);
+		return -1;
 	}
-}
 
-static int dhcp_socket_encode(UNUSED rad_listen_t *listener, UNUSED REQUEST *request)
-{
-	DEBUG2("NO ENCODE!");
 	return 0;
 }
 
-
-static int dhcp_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
+static int mod_load(void)
 {
-	return fr_dhcpv4_packet_decode(request->packet);
-}
-
-
-/*
- *	Ensure that the "dhcp FOO" sections are compiled.
- */
-static int dhcp_listen_compile(CONF_SECTION *server_cs, CONF_SECTION *listen_cs)
-{
-	CONF_SECTION *subcs = NULL;
-	fr_dict_attr_t const *da;
-	fr_dict_enum_t const *dv;
-
-	da = fr_dict_attr_by_name(NULL, "DHCP-Message-Type");
-	if (!da) {
-		cf_log_err(listen_cs, "No DHCP-Message-Type attribute found");
+	if (fr_dict_read(main_config.dict, main_config.dictionary_dir, "dictionary.dhcp") < 0) {
+		ERROR("Failed reading DHCP dictionary: %s", fr_strerror());
 		return -1;
 	}
 
-	while ((subcs = cf_section_find_next(server_cs, subcs, "dhcp", NULL))) {
-		char const *name2 = cf_section_name2(subcs);
-
-
-		if (name2) {
-			cf_log_debug(subcs, "Loading dhcp %s {...}", name2);
-		} else {
-			cf_log_debug(subcs, "Loading dhcp {...}");
-		}
-
-		dv = fr_dict_enum_by_alias(NULL, da, name2);
-		if (!dv) {
-			cf_log_err(subcs, "Server contains 'dhcp %s {...}, but there is no such value for "
-				   "DHCP-Message-Type", name2);
-			return -1;
-		}
-
-		if (unlang_compile(subcs, MOD_POST_AUTH) < 0) {
-			cf_log_err(subcs, "Failed compiling 'dhcp %s' section", name2);
-			return -1;
-		}
-	}
-
-	return 0;
-}
-
-static int dhcp_load(void)
-{
-	int ret;
-
-	ret = fr_dict_read(main_config.dict, main_config.dictionary_dir, "dictionary.dhcp");
 	if (fr_dhcpv4_init() < 0) {
 		ERROR("%s", fr_strerror());
 		return -1;
 	}
 
-	return ret;
+	return 0;
 }
 
-
-extern rad_protocol_t proto_dhcp;
-rad_protocol_t proto_dhcp = {
+fr_app_t proto_dhcpv4 = {
 	.magic		= RLM_MODULE_INIT,
-	.name		= "dhcp",
-	.inst_size	= sizeof(dhcp_socket_t),
-	.transports	= TRANSPORT_UDP,
-	.tls		= false,
-
-	.load		= dhcp_load,
-	.compile	= dhcp_listen_compile,
-	.parse		= dhcp_socket_parse,
-	.open		= common_socket_open,
-	.recv		= dhcp_socket_recv,
-	.send		= dhcp_socket_send,
-	.print		= common_socket_print,
-	.debug		= dhcp_packet_debug,
-	.encode		= dhcp_socket_encode,
-	.decode		= dhcp_socket_decode,
+	.name		= "dhcpv4",
+	.config		= proto_dhcpv4_config,
+	.inst_size	= sizeof(proto_dhcpv4_t),
+
+	.load		= mod_load,
+	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate,
+	.open		= mod_open,
+	.decode		= mod_decode,
+	.encode		= mod_encode,
+	.process_set	= mod_process_set
 };
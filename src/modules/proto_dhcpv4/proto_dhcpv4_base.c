@@ -0,0 +1,481 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_dhcpv4/proto_dhcpv4_base.c
+ * @brief DHCPv4 processing.
+ *
+ * @copyright 2017 The Freeradius server project.
+ * @copyright 2008,2016 Alan DeKok (aland@deployingradius.com)
+ */
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/protocol.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/dict.h>
+#include <freeradius-devel/dhcpv4/dhcpv4.h>
+#include <freeradius-devel/rad_assert.h>
+
+/*
+ *	Fields which are copied from the request to the reply, if
+ *	the reply doesn't already have them.
+ */
+static const uint32_t attrnums[] = {
+	57,	/* DHCP-DHCP-Maximum-Msg-Size */
+	256,	/* DHCP-Opcode */
+	257,	/* DHCP-Hardware-Type */
+	258,	/* DHCP-Hardware-Address-Length */
+	259,	/* DHCP-Hop-Count */
+	260,	/* DHCP-Transaction-Id */
+	262,	/* DHCP-Flags */
+	263,	/* DHCP-Client-IP-Address */
+	266,	/* DHCP-Gateway-IP-Address */
+	267	/* DHCP-Client-Hardware-Address */
+};
+
+/** Find the name of a DHCP-Message-Type
+ *
+ */
+static fr_dict_enum_t const *message_type_enum(unsigned int code)
+{
+	fr_dict_attr_t const *da;
+
+	da = fr_dict_attr_by_num(NULL, DHCP_MAGIC_VENDOR, FR_DHCPV4_MESSAGE_TYPE);
+	rad_assert(da != NULL);
+
+	return fr_dict_enum_by_value(NULL, da, fr_box_uint8(code - FR_DHCPV4_OFFSET));
+}
+
+/** Figure out where the reply goes
+ *
+ *  RFC 2131, page 23.  Replies go to the nearest relay, or the
+ *  gateway, if there is one.  NAKs, and packets from clients which
+ *  asked for a broadcast and have no address, are broadcast.
+ *  Otherwise the reply is unicast to ciaddr, or to yiaddr.
+ *
+ *  A reply to yiaddr goes to a client which doesn't have its address
+ *  yet.  The transport knows how to get it there.
+ *
+ * @param[in] request	the reply is for.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the reply can't be sent.
+ */
+static int reply_address_set(REQUEST *request)
+{
+	VALUE_PAIR *vp;
+
+	request->reply->dst_ipaddr.af = AF_INET;
+	request->reply->dst_ipaddr.prefix = 32;
+	request->reply->src_ipaddr.af = AF_INET;
+	request->reply->src_ipaddr.prefix = 32;
+	request->reply->src_ipaddr.addr.v4.s_addr = htonl(INADDR_ANY);
+
+	/*
+	 *	Packet-Src-IP-Address has highest precedence
+	 */
+	vp = fr_pair_find_by_num(request->reply->vps, 0, FR_PACKET_SRC_IP_ADDRESS, TAG_ANY);
+	if (vp) {
+		request->reply->if_index = 0;	/* Must be 0, we don't know the outbound if_index */
+		request->reply->src_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
+	/*
+	 *	The request was unicast (via a relay)
+	 */
+	} else if ((request->packet->dst_ipaddr.addr.v4.s_addr != htonl(INADDR_BROADCAST)) &&
+		   (request->packet->dst_ipaddr.addr.v4.s_addr != htonl(INADDR_ANY))) {
+		request->reply->src_ipaddr.addr.v4.s_addr = request->packet->dst_ipaddr.addr.v4.s_addr;
+		request->reply->if_index = request->packet->if_index;
+	}
+	/*
+	 *	Otherwise the transport uses its own address.
+	 */
+
+	request->reply->dst_port = request->packet->src_port;
+	request->reply->src_port = request->packet->dst_port;
+
+	/*
+	 *	Answer to client's nearest DHCP relay.
+	 *
+	 *	Which may be different than the giaddr given in the
+	 *	packet to the client.  i.e. the relay may have a
+	 *	public IP, but the gateway a private one.
+	 */
+	vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 272, TAG_ANY); /* DHCP-Relay-IP-Address */
+	if (vp && (vp->vp_ipv4addr != htonl(INADDR_ANY))) {
+		RDEBUG2("Reply will be unicast to giaddr from original packet");
+		request->reply->dst_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
+		request->reply->dst_port = request->packet->dst_port;
+
+		vp = fr_pair_find_by_num(request->reply->vps, 0, FR_PACKET_DST_PORT, TAG_ANY);
+		if (vp) request->reply->dst_port = vp->vp_uint32;
+
+		return 0;
+	}
+
+	/*
+	 *	Answer to client's nearest DHCP gateway.  In this
+	 *	case, the client can reach the gateway, as can the
+	 *	server.
+	 *
+	 *	We also use *our* source port as the destination port.
+	 *	Gateways are servers, and listen on the server port,
+	 *	not the client port.
+	 */
+	vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 266, TAG_ANY); /* DHCP-Gateway-IP-Address */
+	if (vp && (vp->vp_ipv4addr != htonl(INADDR_ANY))) {
+		RDEBUG2("Reply will be unicast to giaddr");
+		request->reply->dst_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
+		request->reply->dst_port = request->packet->dst_port;
+		return 0;
+	}
+
+	/*
+	 *	If it's a NAK, or the broadcast flag was set, ond
+	 *	there's no client-ip-address, send a broadcast.
+	 */
+	if ((request->reply->code == FR_DHCPV4_NAK) ||
+	    ((vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 262, TAG_ANY)) && /* DHCP-Flags */
+	     (vp->vp_uint32 & 0x8000) &&
+	     ((vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 263, TAG_ANY)) && /* DHCP-Client-IP-Address */
+	      (vp->vp_ipv4addr == htonl(INADDR_ANY))))) {
+		RDEBUG2("Reply will be broadcast");
+		request->reply->dst_ipaddr.addr.v4.s_addr = htonl(INADDR_BROADCAST);
+		return 0;
+	}
+
+	/*
+	 *	Unicast to ciaddr if present, otherwise to yiaddr.
+	 */
+	if ((vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 263, TAG_ANY)) && /* DHCP-Client-IP-Address */
+	    (vp->vp_ipv4addr != htonl(INADDR_ANY))) {
+		RDEBUG2("Reply will be sent unicast to &DHCP-Client-IP-Address");
+		request->reply->dst_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
+		return 0;
+	}
+
+	vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 264, TAG_ANY); /* DHCP-Your-IP-Address */
+	if (!vp) {
+		REDEBUG("Can't assign address to client: Neither &reply:DHCP-Client-IP-Address nor "
+			"&reply:DHCP-Your-IP-Address set");
+		return -1;
+	}
+
+	RDEBUG2("Reply will be unicast to &DHCP-Your-IP-Address");
+	request->reply->dst_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
+
+	return 0;
+}
+
+/** Fill in the parts of the reply which come from the request
+ *
+ */
+static int reply_prepare(REQUEST *request)
+{
+	unsigned int	i;
+	VALUE_PAIR	*vp;
+
+	/*
+	 *	Copy specific fields from packet to reply, if they
+	 *	don't already exist
+	 */
+	for (i = 0; i < sizeof(attrnums) / sizeof(attrnums[0]); i++) {
+		uint32_t attr = attrnums[i];
+
+		if (fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, attr, TAG_ANY)) continue;
+
+		vp = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, attr, TAG_ANY);
+		if (vp) {
+			fr_pair_add(&request->reply->vps, fr_pair_copy(request->reply, vp));
+		}
+	}
+
+	vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 256, TAG_ANY); /* DHCP-Opcode */
+	if (!vp) {
+		RPEDEBUG("Someone deleted the DHCP-Opcode!");
+		return -1;
+	}
+	vp->vp_uint8 = 2; /* BOOTREPLY */
+
+	return reply_address_set(request);
+}
+
+/** Set the reply code from the result of the "recv" section
+ *
+ */
+static void reply_code_set(REQUEST *request, rlm_rcode_t rcode)
+{
+	VALUE_PAIR *vp;
+
+	vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, FR_DHCPV4_MESSAGE_TYPE, TAG_ANY);
+	if (vp) {
+		request->reply->code = vp->vp_uint8;
+		if ((request->reply->code != 0) &&
+		    (request->reply->code < FR_DHCPV4_OFFSET)) {
+			request->reply->code += FR_DHCPV4_OFFSET;
+		}
+	}
+	else switch (rcode) {
+	case RLM_MODULE_OK:
+	case RLM_MODULE_UPDATED:
+		if (request->packet->code == FR_DHCPV4_DISCOVER) {
+			request->reply->code = FR_DHCPV4_OFFER;
+			break;
+
+		} else if (request->packet->code == FR_DHCPV4_REQUEST) {
+			request->reply->code = FR_DHCPV4_ACK;
+			break;
+		}
+		request->reply->code = FR_DHCPV4_NAK;
+		break;
+
+	default:
+	case RLM_MODULE_REJECT:
+	case RLM_MODULE_FAIL:
+	case RLM_MODULE_INVALID:
+	case RLM_MODULE_NOOP:
+	case RLM_MODULE_NOTFOUND:
+		if (request->packet->code == FR_DHCPV4_DISCOVER) {
+			request->reply->code = 0; /* ignore the packet */
+		} else {
+			request->reply->code = FR_DHCPV4_NAK;
+		}
+		break;
+
+	case RLM_MODULE_HANDLED:
+		request->reply->code = 0; /* ignore the packet */
+		break;
+	}
+
+	/*
+	 *	Releases don't get replies.
+	 */
+	if (request->packet->code == FR_DHCPV4_RELEASE) request->reply->code = 0;
+
+	if ((request->reply->code != 0) &&
+	    ((request->reply->code <= FR_DHCPV4_OFFSET) || (request->reply->code >= FR_DHCPV4_MAX))) {
+		RWDEBUG("Invalid DHCP-Message-Type %u in reply", request->reply->code);
+		request->reply->code = 0;
+	}
+}
+
+static fr_io_final_t mod_process(REQUEST *request, UNUSED fr_io_action_t action)
+{
+	rlm_rcode_t rcode;
+	CONF_SECTION *unlang;
+	fr_dict_enum_t const *dv;
+	VALUE_PAIR *vp;
+
+	VERIFY_REQUEST(request);
+
+	switch (request->request_state) {
+	case REQUEST_INIT:
+		dv = message_type_enum(request->packet->code);
+		if (!dv) {
+			REDEBUG("Unknown DHCP-Message-Type %u", request->packet->code - FR_DHCPV4_OFFSET);
+			return FR_IO_FAIL;
+		}
+
+		radlog_request(L_DBG, L_DBG_LVL_1, request, "Received %s XID %08x from %pV:%u",
+			       dv->alias, request->packet->id,
+			       fr_box_ipaddr(request->packet->src_ipaddr), request->packet->src_port);
+		rdebug_pair_list(L_DBG_LVL_1, request, request->packet->vps, "");
+
+		request->component = "dhcpv4";
+
+		/*
+		 *	If there's a giaddr, save it as the Relay-IP-Address
+		 *	in the response.  That way the later code knows where
+		 *	to send the reply.
+		 */
+		vp = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 266, TAG_ANY); /* DHCP-Gateway-IP-Address */
+		if (vp && (vp->vp_ipv4addr != htonl(INADDR_ANY))) {
+			VALUE_PAIR *relay;
+
+			/* DHCP-Relay-IP-Address */
+			relay = radius_pair_create(request->reply, &request->reply->vps,
+						   272, DHCP_MAGIC_VENDOR);
+			if (relay) relay->vp_ip = vp->vp_ip;
+		}
+
+		unlang = cf_section_find(request->server_cs, "recv", dv->alias);
+		if (!unlang) {
+			RWDEBUG("Failed to find 'recv %s' section", dv->alias);
+			request->reply->code = 0;
+			goto send_reply;
+		}
+
+		RDEBUG("Running 'recv %s' from file %s", cf_section_name2(unlang), cf_filename(unlang));
+		unlang_push_section(request, unlang, RLM_MODULE_NOOP);
+
+		request->request_state = REQUEST_RECV;
+		/* FALL-THROUGH */
+
+	case REQUEST_RECV:
+		rcode = unlang_interpret_continue(request);
+
+		if (request->master_state == REQUEST_STOP_PROCESSING) return FR_IO_DONE;
+
+		if (rcode == RLM_MODULE_YIELD) return FR_IO_YIELD;
+
+		rad_assert(request->log.unlang_indent == 0);
+
+		reply_code_set(request, rcode);
+
+		/*
+		 *	Relaying isn't done by this listener.  Packets
+		 *	from servers, and packets we're told to relay,
+		 *	are ignored.
+		 */
+		vp = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 256, TAG_ANY); /* DHCP-Opcode */
+		if ((vp && (vp->vp_uint8 == 2)) ||
+		    fr_pair_find_by_num(request->control, DHCP_MAGIC_VENDOR, 270, TAG_ANY)) { /* DHCP-Relay-To-IP-Address */
+			RWDEBUG("DHCP relaying is not supported by this listener");
+			request->reply->code = 0;
+		}
+
+		if (request->reply->code == 0) goto send_reply;
+
+		dv = message_type_enum(request->reply->code);
+		unlang = NULL;
+		if (dv) unlang = cf_section_find(request->server_cs, "send", dv->alias);
+
+		if (!unlang) goto send_reply;
+
+	rerun_nak:
+		RDEBUG("Running 'send %s' from file %s", cf_section_name2(unlang), cf_filename(unlang));
+		unlang_push_section(request, unlang, RLM_MODULE_NOOP);
+
+		request->request_state = REQUEST_SEND;
+		/* FALL-THROUGH */
+
+	case REQUEST_SEND:
+		rcode = unlang_interpret_continue(request);
+
+		if (request->master_state == REQUEST_STOP_PROCESSING) return FR_IO_DONE;
+
+		if (rcode == RLM_MODULE_YIELD) return FR_IO_YIELD;
+
+		rad_assert(request->log.unlang_indent == 0);
+
+		switch (rcode) {
+		case RLM_MODULE_NOOP:
+		case RLM_MODULE_OK:
+		case RLM_MODULE_UPDATED:
+		case RLM_MODULE_HANDLED:
+			/* reply is already set */
+			break;
+
+		default:
+			/*
+			 *	If we over-ride an ACK with a NAK, run
+			 *	the NAK section.  Anything else which
+			 *	fails isn't sent.
+			 */
+			if (request->reply->code != FR_DHCPV4_ACK) {
+				request->reply->code = 0;
+				break;
+			}
+
+			RWDEBUG("Failed running 'send DHCP-Ack', trying 'send DHCP-NAK'.");
+
+			request->reply->code = FR_DHCPV4_NAK;
+
+			dv = message_type_enum(request->reply->code);
+			unlang = NULL;
+			if (dv) unlang = cf_section_find(request->server_cs, "send", dv->alias);
+			if (unlang) goto rerun_nak;
+
+			RWDEBUG("Not running 'send DHCP-NAK' section as it does not exist");
+			break;
+		}
+
+	send_reply:
+		/*
+		 *	Check for "do not respond".
+		 */
+		if (request->reply->code == 0) {
+			RDEBUG("Not sending reply to client.");
+			return FR_IO_DONE;
+		}
+
+		if (reply_prepare(request) < 0) {
+			RDEBUG("Not sending reply to client.");
+			return FR_IO_DONE;
+		}
+
+		if (RDEBUG_ENABLED) {
+			dv = message_type_enum(request->reply->code);
+
+			radlog_request(L_DBG, L_DBG_LVL_1, request, "Sending %s XID %08x to %pV:%u",
+				       dv ? dv->alias : "reply", request->reply->id,
+				       fr_box_ipaddr(request->reply->dst_ipaddr), request->reply->dst_port);
+			rdebug_proto_pair_list(L_DBG_LVL_1, request, request->reply->vps, "");
+		}
+		break;
+
+	default:
+		return FR_IO_FAIL;
+	}
+
+	return FR_IO_REPLY;
+}
+
+
+/*
+ *	Ensure that the "recv foo" etc. sections are compiled.
+ */
+static int mod_instantiate(UNUSED void *instance, CONF_SECTION *listen_cs)
+{
+	int rcode;
+	bool found = false;
+	unsigned int code;
+	CONF_SECTION *server_cs;
+
+	rad_assert(listen_cs);
+
+	server_cs = cf_item_to_section(cf_parent(listen_cs));
+	rad_assert(strcmp(cf_section_name1(server_cs), "server") == 0);
+
+	for (code = FR_DHCPV4_DISCOVER; code < FR_DHCPV4_MAX; code++) {
+		fr_dict_enum_t const *dv;
+
+		dv = message_type_enum(code);
+		if (!dv) continue;
+
+		rcode = unlang_compile_subsection(server_cs, "recv", dv->alias, MOD_AUTHORIZE);
+		if (rcode < 0) return rcode;
+		if (rcode > 0) found = true;
+
+		rcode = unlang_compile_subsection(server_cs, "send", dv->alias, MOD_POST_AUTH);
+		if (rcode < 0) return rcode;
+	}
+
+	if (!found) {
+		cf_log_err(server_cs, "Failed finding any 'recv DHCP-...  { ... }' section of virtual server %s",
+			   cf_section_name2(server_cs));
+		return -1;
+	}
+
+	return 0;
+}
+
+extern fr_app_process_t proto_dhcpv4_base;
+fr_app_process_t proto_dhcpv4_base = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "dhcpv4_base",
+	.instantiate	= mod_instantiate,
+	.process	= mod_process,
+};
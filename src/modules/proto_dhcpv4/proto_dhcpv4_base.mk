@@ -0,0 +1,9 @@
+TARGETNAME	:= proto_dhcpv4_base
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME).a
+endif
+
+SOURCES		:= proto_dhcpv4_base.c
+
+TGT_PREREQS	:= libfreeradius-dhcpv4.a libfreeradius-util.a
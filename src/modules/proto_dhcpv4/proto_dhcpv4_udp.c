@@ -0,0 +1,778 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_dhcpv4_udp.c
+ * @brief DHCPv4 handler for UDP.
+ *
+ * @copyright 2017 The FreeRADIUS server project.
+ */
+#include <netdb.h>
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/protocol.h>
+#include <freeradius-devel/udp.h>
+#include <freeradius-devel/io/io.h>
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/rad_assert.h>
+#include "proto_dhcpv4.h"
+
+#ifndef __MINGW32__
+#  include <sys/ioctl.h>
+#endif
+
+/*
+ *	Goes in front of the DHCP packet in the message buffer, for
+ *	both requests and replies.  The worker releases the request
+ *	message before we write the reply, so the reply carries its
+ *	own copy.
+ */
+typedef struct {
+	fr_ipaddr_t			src_ipaddr;
+	fr_ipaddr_t			dst_ipaddr;
+	uint16_t			src_port;
+	uint16_t 			dst_port;
+	int				if_index;
+
+	bool				link_layer;		//!< The reply is for a client without an
+								///< IP address, and has to be sent to chaddr.
+	uint8_t				chaddr[DHCP_CHADDR_LEN];
+} proto_dhcpv4_udp_address_t;
+
+/** A batch of datagrams read from, or to be written to, the socket
+ *
+ */
+typedef struct {
+	udp_datagram_t			dg[UDP_BATCH_MAX];	//!< The datagrams.
+	uint8_t				*buffer;		//!< "batch" * MAX_PACKET_SIZE bytes of packet data.
+	int				num;			//!< Number of datagrams in the batch.
+	int				next;			//!< Next datagram to return from mod_read().
+	bool				refilled;		//!< The batch was read during this readiness event.
+} proto_dhcpv4_udp_batch_t;
+
+typedef struct {
+	proto_dhcpv4_t	const		*parent;		//!< The module that spawned us!
+
+	int				sockfd;
+
+	fr_ipaddr_t			ipaddr;			//!< Ipaddr to listen on.
+	fr_ipaddr_t			src_ipaddr;		//!< Ipaddr to send replies from.
+
+	bool				ipaddr_is_set;		//!< ipaddr config item is set.
+	bool				src_ipaddr_is_set;	//!< src_ipaddr config item is set.
+
+	char const			*interface;		//!< Interface to bind to.
+	char const			*port_name;		//!< Name of the port for getservent().
+
+	uint16_t			port;			//!< Port to listen on.
+	uint32_t			recv_buff;		//!< How big the kernel's receive buffer should be.
+	bool				recv_buff_is_set;	//!< Whether we were provided with a receive
+								//!< buffer value.
+	bool				broadcast;		//!< Whether we listen for, and send, broadcasts.
+
+	uint32_t			batch;			//!< Maximum number of packets to read or write
+								//!< with one system call.
+	proto_dhcpv4_udp_batch_t	*rx;			//!< Packets we've read, but not yet returned.
+	proto_dhcpv4_udp_batch_t	*tx;			//!< Replies we haven't yet written.
+
+	bool				raw;			//!< Send replies to clients without an IP
+								///< address via a raw socket.
+	uint32_t			tx_ring;		//!< Number of frames in the raw socket's TX ring.
+								///< 0 means write frames one at a time.
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+	int				raw_sockfd;		//!< Raw socket for replies to chaddr.
+	struct sockaddr_ll		link_layer;		//!< Interface the raw socket is bound to.
+	uint8_t				ethernet[ETH_ADDR_LEN];	//!< Our Ethernet address.
+	fr_dhcpv4_raw_ring_t		*ring;			//!< The TX ring, if "tx_ring" is set.
+#endif
+} proto_dhcpv4_udp_t;
+
+static const CONF_PARSER udp_listen_config[] = {
+	{ FR_CONF_IS_SET_OFFSET("ipaddr", FR_TYPE_IPV4_ADDR, proto_dhcpv4_udp_t, ipaddr) },
+	{ FR_CONF_IS_SET_OFFSET("src_ipaddr", FR_TYPE_IPV4_ADDR, proto_dhcpv4_udp_t, src_ipaddr) },
+
+	{ FR_CONF_OFFSET("interface", FR_TYPE_STRING, proto_dhcpv4_udp_t, interface) },
+	{ FR_CONF_OFFSET("port_name", FR_TYPE_STRING, proto_dhcpv4_udp_t, port_name), .dflt = "bootps" },
+
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, proto_dhcpv4_udp_t, port) },
+	{ FR_CONF_IS_SET_OFFSET("recv_buff", FR_TYPE_UINT32, proto_dhcpv4_udp_t, recv_buff) },
+
+	{ FR_CONF_OFFSET("broadcast", FR_TYPE_BOOL, proto_dhcpv4_udp_t, broadcast), .dflt = "yes" },
+
+	{ FR_CONF_OFFSET("batch", FR_TYPE_UINT32, proto_dhcpv4_udp_t, batch), .dflt = "32" },
+
+	{ FR_CONF_OFFSET("raw", FR_TYPE_BOOL, proto_dhcpv4_udp_t, raw), .dflt = "no" },
+	{ FR_CONF_OFFSET("tx_ring", FR_TYPE_UINT32, proto_dhcpv4_udp_t, tx_ring), .dflt = "256" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+
+/** Return the src address associated with the packet_ctx
+ *
+ */
+static int mod_src_address(fr_socket_addr_t *src, UNUSED void const *instance, void const *packet_ctx)
+{
+	proto_dhcpv4_udp_address_t address;
+
+	memcpy(&address, packet_ctx, sizeof(address));
+
+	memset(src, 0, sizeof(*src));
+
+	src->proto = IPPROTO_UDP;
+	src->ipaddr = address.src_ipaddr;
+	src->port = address.src_port;
+
+	return 0;
+}
+
+/** Return the dst address associated with the packet_ctx
+ *
+ */
+static int mod_dst_address(fr_socket_addr_t *dst, UNUSED void const *instance, void const *packet_ctx)
+{
+	proto_dhcpv4_udp_address_t address;
+
+	memcpy(&address, packet_ctx, sizeof(address));
+
+	memset(dst, 0, sizeof(*dst));
+
+	dst->proto = IPPROTO_UDP;
+	dst->ipaddr = address.dst_ipaddr;
+	dst->port = address.dst_port;
+
+	return 0;
+}
+
+/** Fill in the addresses, and point the packet at the DHCP data
+ *
+ */
+static int mod_decode(UNUSED void const *instance, REQUEST *request, uint8_t *const data, size_t data_len)
+{
+	proto_dhcpv4_udp_address_t address;
+
+	if (data_len < sizeof(address)) return -1;
+
+	memcpy(&address, data, sizeof(address));
+
+	request->packet->if_index = address.if_index;
+	request->packet->src_ipaddr = address.src_ipaddr;
+	request->packet->src_port = address.src_port;
+	request->packet->dst_ipaddr = address.dst_ipaddr;
+	request->packet->dst_port = address.dst_port;
+
+	request->reply->if_index = address.if_index;
+	request->reply->src_ipaddr = address.dst_ipaddr;
+	request->reply->src_port = address.dst_port;
+	request->reply->dst_ipaddr = address.src_ipaddr;
+	request->reply->dst_port = address.src_port;
+
+	request->packet->data = data + sizeof(address);
+	request->packet->data_len = data_len - sizeof(address);
+
+	request->root = &main_config;
+	VERIFY_REQUEST(request);
+
+	return 0;
+}
+
+/** Put the addresses for the reply in front of the encoded packet
+ *
+ *  The process module has chosen the destination.  This is where we
+ *  fill in our own address, and decide whether the reply has to go
+ *  to the client's hardware address.
+ */
+static ssize_t mod_encode(void const *instance, REQUEST *request, uint8_t *buffer, size_t buffer_len)
+{
+	proto_dhcpv4_udp_t const	*inst = talloc_get_type_abort(instance, proto_dhcpv4_udp_t);
+	RADIUS_PACKET			*reply = request->reply;
+	proto_dhcpv4_udp_address_t	address;
+	uint32_t			ciaddr, yiaddr;
+
+	if ((sizeof(address) + reply->data_len) > buffer_len) {
+		RDEBUG("Reply is too large (%zu bytes)", reply->data_len);
+		return -1;
+	}
+
+	/*
+	 *	The listener was bound to an IP address, or we were
+	 *	told which address to use.  Otherwise, use the
+	 *	Server-Identifier.
+	 */
+	if (reply->src_ipaddr.addr.v4.s_addr == htonl(INADDR_ANY)) {
+		VALUE_PAIR *vp;
+
+		if (inst->src_ipaddr_is_set) {
+			reply->src_ipaddr = inst->src_ipaddr;
+
+		} else if (inst->ipaddr.addr.v4.s_addr != htonl(INADDR_ANY)) {
+			reply->src_ipaddr = inst->ipaddr;
+
+		} else if ((vp = fr_pair_find_by_num(reply->vps, DHCP_MAGIC_VENDOR, 54, TAG_ANY))) {
+			reply->src_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
+
+		} else {
+			REDEBUG("Unable to determine correct src_ipaddr for response");
+			return -1;
+		}
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.src_ipaddr = reply->src_ipaddr;
+	address.src_port = reply->src_port;
+	address.dst_ipaddr = reply->dst_ipaddr;
+	address.dst_port = reply->dst_port;
+	address.if_index = reply->if_index;
+
+	/*
+	 *	A reply to yiaddr, from a client with no ciaddr, goes
+	 *	to a client which doesn't have its address yet.  The
+	 *	kernel can't ARP for it, so the reply has to go to
+	 *	chaddr.
+	 */
+	memcpy(&ciaddr, reply->data + 12, sizeof(ciaddr));
+	memcpy(&yiaddr, reply->data + 16, sizeof(yiaddr));
+
+	if ((ciaddr == htonl(INADDR_ANY)) && (yiaddr != htonl(INADDR_ANY)) &&
+	    (reply->dst_ipaddr.addr.v4.s_addr == yiaddr)) {
+		address.link_layer = true;
+		memcpy(address.chaddr, reply->data + 28, sizeof(address.chaddr));
+	}
+
+	memcpy(buffer, &address, sizeof(address));
+	memcpy(buffer + sizeof(address), reply->data, reply->data_len);
+
+	return sizeof(address) + reply->data_len;
+}
+
+/** Check a packet before it is passed to a worker
+ *
+ *  Packets which aren't DHCP, and message types this listener
+ *  doesn't handle, are dropped in the network thread.
+ */
+static bool mod_filter(proto_dhcpv4_udp_t const *inst, uint8_t const *packet, size_t packet_len)
+{
+	uint8_t		code;
+	int		xid;
+
+	if (!fr_dhcpv4_ok(packet, packet_len, &code, &xid)) {
+		DEBUG2("proto_dhcpv4_udp got invalid packet: %s", fr_strerror());
+		return false;
+	}
+
+	if (!inst->parent->code_allowed[code]) {
+		DEBUG2("proto_dhcpv4_udp ignoring %s, which this listener isn't configured to accept",
+		       dhcp_message_types[code]);
+		return false;
+	}
+
+	return true;
+}
+
+/** Read a packet from the socket
+ *
+ *  When "batch" is more than one, we read up to "batch" packets
+ *  with one system call, and return them one at a time.  Packets
+ *  which are ignored are skipped here, so that we only return 0
+ *  when there's nothing left to read.
+ */
+static ssize_t mod_read(void const *instance, void **packet_ctx, fr_time_t **recv_time, uint8_t *buffer, size_t buffer_len)
+{
+	proto_dhcpv4_udp_t const	*inst = talloc_get_type_abort(instance, proto_dhcpv4_udp_t);
+	proto_dhcpv4_udp_batch_t	*rx = inst->rx;
+	proto_dhcpv4_udp_address_t	address;
+	uint8_t				*packet = buffer + sizeof(address);
+	size_t				packet_len = buffer_len - sizeof(address);
+	ssize_t				data_size;
+	struct timeval			timestamp;
+
+	memset(&address, 0, sizeof(address));
+
+	if (!rx) {
+		data_size = udp_recv(inst->sockfd, packet, packet_len, 0,
+				     &address.src_ipaddr, &address.src_port,
+				     &address.dst_ipaddr, &address.dst_port,
+				     &address.if_index, &timestamp);
+		if (data_size <= 0) return data_size;
+
+		if (!mod_filter(inst, packet, data_size)) return 0;
+
+		goto done;
+	}
+
+	for (;;) {
+		udp_datagram_t *dg;
+
+		/*
+		 *	Read at most one batch for each readiness
+		 *	event.  If there's more data, the socket will
+		 *	be readable again, and we'll get called again.
+		 */
+		if (rx->next == rx->num) {
+			int i, rcode;
+
+			if (rx->refilled) {
+				rx->refilled = false;
+				return 0;
+			}
+
+			rx->num = rx->next = 0;
+
+			for (i = 0; i < (int) inst->batch; i++) {
+				rx->dg[i].data = rx->buffer + (i * MAX_PACKET_SIZE);
+				rx->dg[i].data_len = MAX_PACKET_SIZE;
+			}
+
+			rcode = udp_recv_batch(inst->sockfd, rx->dg, inst->batch);
+			if (rcode <= 0) return rcode;
+
+			rx->num = rcode;
+			rx->refilled = true;
+		}
+
+		dg = &rx->dg[rx->next++];
+		if (!dg->data_len || (dg->data_len > packet_len)) continue;
+
+		if (!mod_filter(inst, dg->data, dg->data_len)) continue;
+
+		memcpy(packet, dg->data, dg->data_len);
+		data_size = dg->data_len;
+
+		address.src_ipaddr = dg->src_ipaddr;
+		address.src_port = dg->src_port;
+		address.dst_ipaddr = dg->dst_ipaddr;
+		address.dst_port = dg->dst_port;
+		address.if_index = dg->if_index;
+		break;
+	}
+
+done:
+	memcpy(buffer, &address, sizeof(address));
+
+	*packet_ctx = buffer;
+	*recv_time = NULL;
+
+	return sizeof(address) + data_size;
+}
+
+/** Write any queued replies
+ *
+ * @param[in] instance of the DHCPv4 UDP I/O path.
+ * @return
+ *	- 0 on success.
+ */
+static int mod_flush(void const *instance)
+{
+	proto_dhcpv4_udp_t const	*inst = talloc_get_type_abort(instance, proto_dhcpv4_udp_t);
+	proto_dhcpv4_udp_batch_t	*tx = inst->tx;
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+	if (inst->ring) (void) fr_dhcpv4_raw_ring_flush(inst->ring);
+#endif
+
+	if (!tx || !tx->num) return 0;
+
+	(void) udp_send_batch(inst->sockfd, tx->dg, tx->num);
+	tx->num = 0;
+
+	return 0;
+}
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+/** Send a reply to the client's hardware address
+ *
+ * @return
+ *	- 0 if the reply was sent, or queued.
+ *	- -1 if it has to be sent some other way.
+ */
+static int mod_write_raw(proto_dhcpv4_udp_t const *inst, proto_dhcpv4_udp_address_t const *address,
+			 uint8_t const *packet, size_t packet_len)
+{
+	uint8_t		frame[1518];
+	ssize_t		frame_len;
+
+	if (inst->raw_sockfd < 0) return -1;
+
+	if (inst->ring) {
+		return fr_dhcpv4_raw_ring_queue(inst->ring, inst->ethernet, address->chaddr,
+						&address->src_ipaddr, address->src_port,
+						&address->dst_ipaddr, address->dst_port,
+						packet, packet_len);
+	}
+
+	frame_len = fr_dhcpv4_raw_frame_build(frame, sizeof(frame), inst->ethernet, address->chaddr,
+					      &address->src_ipaddr, address->src_port,
+					      &address->dst_ipaddr, address->dst_port,
+					      packet, packet_len);
+	if (frame_len < 0) return -1;
+
+	if (sendto(inst->raw_sockfd, frame, frame_len, 0,
+		   (struct sockaddr const *) &inst->link_layer, sizeof(inst->link_layer)) < 0) {
+		fr_strerror_printf("Failed sending raw frame: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+static ssize_t mod_write(void const *instance, UNUSED void *packet_ctx,
+			 UNUSED fr_time_t request_time, uint8_t *buffer, size_t buffer_len)
+{
+	proto_dhcpv4_udp_t const	*inst = talloc_get_type_abort(instance, proto_dhcpv4_udp_t);
+	proto_dhcpv4_udp_address_t	address;
+	uint8_t				*packet;
+	size_t				packet_len;
+
+	/*
+	 *	Don't reply.
+	 */
+	if (buffer_len <= sizeof(address)) return buffer_len;
+
+	memcpy(&address, buffer, sizeof(address));
+
+	packet = buffer + sizeof(address);
+	packet_len = buffer_len - sizeof(address);
+
+	if (address.link_layer) {
+#ifdef HAVE_LINUX_IF_PACKET_H
+		if (mod_write_raw(inst, &address, packet, packet_len) == 0) return buffer_len;
+#endif
+
+		/*
+		 *	Update the ARP table, so that the kernel can
+		 *	send the reply.  If we can't do that, the
+		 *	reply is broadcast.
+		 */
+		if (!inst->interface ||
+		    (fr_dhcpv4_udp_add_arp_entry(inst->sockfd, inst->interface,
+						 &address.dst_ipaddr, address.chaddr) < 0)) {
+			address.dst_ipaddr.addr.v4.s_addr = htonl(INADDR_BROADCAST);
+		}
+	}
+
+	if (inst->tx) {
+		proto_dhcpv4_udp_batch_t	*tx = inst->tx;
+		udp_datagram_t			*dg;
+
+		/*
+		 *	Queue the reply, to be written by mod_flush().
+		 */
+		if (tx->num == (int) inst->batch) (void) mod_flush(inst);
+
+		dg = &tx->dg[tx->num++];
+		dg->data = tx->buffer + ((tx->num - 1) * MAX_PACKET_SIZE);
+		dg->data_len = packet_len;
+		memcpy(dg->data, packet, packet_len);
+
+		dg->src_ipaddr = address.src_ipaddr;
+		dg->src_port = address.src_port;
+		dg->dst_ipaddr = address.dst_ipaddr;
+		dg->dst_port = address.dst_port;
+		dg->if_index = address.if_index;
+
+		return buffer_len;
+	}
+
+	if (udp_send(inst->sockfd, packet, packet_len, 0,
+		     &address.src_ipaddr, address.src_port,
+		     address.if_index,
+		     &address.dst_ipaddr, address.dst_port) < 0) return -1;
+
+	/*
+	 *	Tell the caller we've written it all.
+	 */
+	return buffer_len;
+}
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+/** Open the raw socket used to reply to clients without an IP address
+ *
+ */
+static int mod_open_raw(proto_dhcpv4_udp_t *inst)
+{
+	int		if_index;
+
+	if_index = if_nametoindex(inst->interface);
+	if (!if_index) {
+		ERROR("Failed finding interface %s: %s", inst->interface, fr_syserror(errno));
+		return -1;
+	}
+
+	inst->raw_sockfd = fr_dhcpv4_raw_tx_socket_open(&inst->link_layer, if_index);
+	if (inst->raw_sockfd < 0) {
+		ERROR("Failed opening raw socket: %s", fr_strerror());
+		return -1;
+	}
+
+	if (fr_dhcpv4_raw_if_ethernet(inst->ethernet, inst->raw_sockfd, inst->interface) < 0) {
+		ERROR("%s", fr_strerror());
+	error:
+		close(inst->raw_sockfd);
+		inst->raw_sockfd = -1;
+		return -1;
+	}
+
+	if (inst->tx_ring) {
+		inst->ring = fr_dhcpv4_raw_ring_alloc(inst, inst->raw_sockfd, inst->tx_ring);
+		if (!inst->ring) {
+			ERROR("%s", fr_strerror());
+			goto error;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/** Open a UDP listener for DHCPv4
+ *
+ * @param[in] instance of the DHCPv4 UDP I/O path.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int mod_open(void *instance)
+{
+	proto_dhcpv4_udp_t *inst = talloc_get_type_abort(instance, proto_dhcpv4_udp_t);
+
+	int				sockfd = 0;
+	uint16_t			port = inst->port;
+
+	sockfd = fr_socket_server_udp(&inst->ipaddr, &port, inst->port_name, true);
+	if (sockfd < 0) {
+		ERROR("Failed opening UDP socket: %s", fr_strerror());
+	error:
+		return -1;
+	}
+
+	if (inst->broadcast) {
+		int on = 1;
+
+		if (setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) < 0) {
+			ERROR("Failed setting SO_BROADCAST: %s", fr_syserror(errno));
+			close(sockfd);
+			goto error;
+		}
+	}
+
+	if (inst->recv_buff_is_set) {
+		int opt = inst->recv_buff;
+
+		if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt)) < 0) {
+			WARN("Failed setting 'recv_buff': %s", fr_syserror(errno));
+		}
+	}
+
+	if (fr_socket_bind(sockfd, &inst->ipaddr, &port, inst->interface) < 0) {
+		ERROR("Failed binding socket: %s", fr_strerror());
+		close(sockfd);
+		goto error;
+	}
+
+	inst->sockfd = sockfd;
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+	if (inst->raw && (mod_open_raw(inst) < 0)) {
+		close(sockfd);
+		inst->sockfd = -1;
+		goto error;
+	}
+#endif
+
+	return 0;
+}
+
+/** Get the file descriptor for this socket.
+ *
+ * @param[in] instance of the DHCPv4 UDP I/O path.
+ * @return the file descriptor
+ */
+static int mod_fd(void const *instance)
+{
+	proto_dhcpv4_udp_t *inst = talloc_get_type_abort(instance, proto_dhcpv4_udp_t);
+
+	return inst->sockfd;
+}
+
+/** Close the sockets, and the TX ring if there is one.
+ *
+ * @param[in] instance of the DHCPv4 UDP I/O path.
+ * @return
+ *	- 0 on success.
+ */
+static int mod_close(void const *instance)
+{
+	proto_dhcpv4_udp_t *inst;
+
+	memcpy(&inst, &instance, sizeof(inst)); /* const issues */
+
+	inst = talloc_get_type_abort(inst, proto_dhcpv4_udp_t);
+
+	(void) mod_flush(inst);
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+	TALLOC_FREE(inst->ring);
+
+	if (inst->raw_sockfd >= 0) close(inst->raw_sockfd);
+	inst->raw_sockfd = -1;
+#endif
+
+	if (inst->sockfd >= 0) close(inst->sockfd);
+	inst->sockfd = -1;
+
+	return 0;
+}
+
+static int mod_instantiate(void *instance, CONF_SECTION *cs)
+{
+	proto_dhcpv4_udp_t *inst = talloc_get_type_abort(instance, proto_dhcpv4_udp_t);
+
+	/*
+	 *	DHCPv4 is IPv4 only.  Listen on all addresses by
+	 *	default, as clients send broadcasts.
+	 */
+	if (!inst->ipaddr_is_set) {
+		inst->ipaddr.af = AF_INET;
+		inst->ipaddr.prefix = 32;
+		inst->ipaddr.addr.v4.s_addr = htonl(INADDR_ANY);
+	}
+
+	if (inst->recv_buff_is_set) {
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, >=, 32);
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, <=, INT_MAX);
+	}
+
+	if (!inst->port) {
+		struct servent *s;
+
+		if (!inst->port_name) {
+			cf_log_err(cs, "No 'port' specified in 'udp' section");
+			return -1;
+		}
+
+		s = getservbyname(inst->port_name, "udp");
+		if (!s) {
+			cf_log_err(cs, "Unknown value for 'port_name = %s", inst->port_name);
+			return -1;
+		}
+
+		inst->port = ntohs(s->s_port);
+	}
+
+	if (inst->broadcast && !inst->interface) {
+		WARN("You MUST set \"interface\" if you have \"broadcast = yes\"");
+	}
+
+	if (inst->raw) {
+#ifdef HAVE_LINUX_IF_PACKET_H
+		if (!inst->interface) {
+			cf_log_err(cs, "'raw = yes' requires 'interface' to be set");
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("tx_ring", inst->tx_ring, <=, 65536);
+#else
+		cf_log_err(cs, "'raw = yes' is not supported on this system");
+		return -1;
+#endif
+	}
+
+	FR_INTEGER_BOUND_CHECK("batch", inst->batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("batch", inst->batch, <=, UDP_BATCH_MAX);
+
+	if (inst->batch == 1) return 0;
+
+	inst->rx = talloc_zero(inst, proto_dhcpv4_udp_batch_t);
+	inst->tx = talloc_zero(inst, proto_dhcpv4_udp_batch_t);
+	if (!inst->rx || !inst->tx) {
+	oom:
+		cf_log_err(cs, "Failed allocating batch buffers");
+		return -1;
+	}
+
+	inst->rx->buffer = talloc_array(inst->rx, uint8_t, inst->batch * MAX_PACKET_SIZE);
+	if (!inst->rx->buffer) goto oom;
+
+	inst->tx->buffer = talloc_array(inst->tx, uint8_t, inst->batch * MAX_PACKET_SIZE);
+	if (!inst->tx->buffer) goto oom;
+
+	return 0;
+}
+
+static int mod_bootstrap(void *instance, UNUSED CONF_SECTION *cs)
+{
+	proto_dhcpv4_udp_t	*inst = talloc_get_type_abort(instance, proto_dhcpv4_udp_t);
+	dl_instance_t const	*dl_inst;
+
+	/*
+	 *	Find the dl_instance_t holding our instance data
+	 *	so we can find out what the parent of our instance
+	 *	was.
+	 */
+	dl_inst = dl_instance_find(instance);
+	rad_assert(dl_inst);
+
+	inst->parent = talloc_get_type_abort(dl_inst->parent->data, proto_dhcpv4_t);
+
+	inst->sockfd = -1;
+#ifdef HAVE_LINUX_IF_PACKET_H
+	inst->raw_sockfd = -1;
+#endif
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	proto_dhcpv4_udp_t	*inst = talloc_get_type_abort(instance, proto_dhcpv4_udp_t);
+
+	return mod_close(inst);
+}
+
+
+/** Private interface for use by proto_dhcpv4
+ *
+ */
+extern proto_dhcpv4_app_io_t proto_dhcpv4_app_io_private;
+proto_dhcpv4_app_io_t proto_dhcpv4_app_io_private = {
+	.src			= mod_src_address,
+	.dst			= mod_dst_address
+};
+
+extern fr_app_io_t proto_dhcpv4_udp;
+fr_app_io_t proto_dhcpv4_udp = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "dhcpv4_udp",
+	.config			= udp_listen_config,
+	.inst_size		= sizeof(proto_dhcpv4_udp_t),
+	.detach			= mod_detach,
+	.bootstrap		= mod_bootstrap,
+	.instantiate		= mod_instantiate,
+
+	.default_message_size	= 4096,
+	.max_reads		= UDP_BATCH_MAX + 1,
+	.open			= mod_open,
+	.close			= mod_close,
+	.read			= mod_read,
+	.decode			= mod_decode,
+	.encode			= mod_encode,
+	.write			= mod_write,
+	.flush			= mod_flush,
+	.fd			= mod_fd,
+};
@@ -0,0 +1,9 @@
+TARGETNAME	:= proto_dhcpv4_udp
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME).a
+endif
+
+SOURCES		:= proto_dhcpv4_udp.c
+
+TGT_PREREQS	:= libfreeradius-dhcpv4.a libfreeradius-util.a
@@ -31,6 +31,27 @@
 #include <sys/socket.h>
 #include "sync.h"
 
+typedef struct proto_ldap_change proto_ldap_change_t;
+
+/** Where we are in storing a cookie
+ *
+ */
+typedef enum {
+	CHECKPOINT_IDLE = 0,					//!< No checkpoint in progress.
+	CHECKPOINT_DRAINING,					//!< Waiting for changes received before the
+								//!< cookie to complete.
+	CHECKPOINT_STORING					//!< Waiting for cookie store requests to complete.
+} proto_ldap_checkpoint_t;
+
+/** The cookies we've received for a sync
+ *
+ */
+typedef struct {
+	uint8_t				*latest;		//!< Most recent cookie received.
+	uint8_t				*checkpoint;		//!< Cookie waiting to be stored.
+	int				sync_id;		//!< Of the sync the cookie was received on.
+} proto_ldap_cookie_t;
+
 /** Configuration for listen instance of the proto_ldap_conn
  *
  */
@@ -75,8 +96,60 @@ typedef struct {
 								//!< and /dev/urandom are unavailable.
 
 	uint32_t			ldap_debug;		//!< Debug flag for the SDK.
+
+	/*
+	 *	Change processing
+	 */
+	uint32_t			cookie_interval;	//!< Store the cookie after this many changes.
+	uint32_t			present_batch;		//!< Maximum number of present entries to add
+								//!< to one request.
+
+	/*
+	 *	Updated by the workers as changes complete.
+	 */
+	pthread_mutex_t			mutex;			//!< Protects the fields below.
+	fr_hash_table_t			*in_flight;		//!< Changes being processed, by entry UUID.
+	proto_ldap_change_t		*ready;			//!< Changes which can now be enqueued.
+	uint32_t			outstanding[2];		//!< Changes not yet completed, in each epoch.
+	int				epoch;			//!< Epoch new changes are counted in.
+	proto_ldap_checkpoint_t		checkpoint;		//!< State of cookie storage.
+	uint32_t			stores;			//!< Cookie store requests not yet completed.
+
+	int				notify_fd[2];		//!< Workers write to this to wake the listener.
+
+	/*
+	 *	Only used by the listener.
+	 */
+	proto_ldap_cookie_t		*cookies;		//!< One for each sync.
+	uint32_t			changes;		//!< Changes since the last checkpoint.
+	bool				checkpoint_now;		//!< Store the cookie regardless of cookie_interval.
+
+	REQUEST				*present;		//!< Present entries not yet enqueued.
+	sync_config_t const		*present_config;	//!< Sync the present entries are for.
+	uint32_t			present_count;		//!< Number of present entries in the request.
 } proto_ldap_inst_t;
 
+/** A change being processed by a worker
+ *
+ * Changes to the same entry are processed one at a time, in the order they
+ * were received.  Changes to different entries are processed in parallel.
+ */
+struct proto_ldap_change {
+	proto_ldap_inst_t		*inst;			//!< Instance the change was received by.
+	REQUEST				*request;		//!< Processing the change.
+
+	uint8_t				uuid[SYNC_UUID_LENGTH];	//!< Of the entry.
+	bool				keyed;			//!< Whether uuid identifies a single entry.
+	bool				cookie;			//!< Request stores a cookie, and isn't a change.
+
+	int				epoch;			//!< The change was counted in.
+
+	proto_ldap_change_t		*next;			//!< Next change to the same entry.
+	proto_ldap_change_t		*ready_next;		//!< Next change which can be enqueued.
+};
+
+extern rad_protocol_t proto_ldap_sync;
+
 typedef enum {
 	LDAP_SYNC_CODE_PRESENT	= SYNC_STATE_PRESENT,
 	LDAP_SYNC_CODE_ADD	= SYNC_STATE_ADD,
@@ -178,6 +251,9 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("sync_retry_interval", FR_TYPE_TIMEVAL, proto_ldap_inst_t, sync_retry_interval), .dflt = "5" },
 	{ FR_CONF_OFFSET("conn_retry_interval", FR_TYPE_TIMEVAL, proto_ldap_inst_t, conn_retry_interval), .dflt = "5" },
 
+	{ FR_CONF_OFFSET("cookie_interval", FR_TYPE_UINT32, proto_ldap_inst_t, cookie_interval), .dflt = "100" },
+	{ FR_CONF_OFFSET("present_batch", FR_TYPE_UINT32, proto_ldap_inst_t, present_batch), .dflt = "1" },
+
 	/*
 	 *	Areas of the DIT to listen on
 	 */
@@ -282,6 +358,85 @@ static void proto_ldap_packet_debug(REQUEST *request, RADIUS_PACKET *packet, boo
 	return;
 }
 
+static uint32_t proto_ldap_change_hash(void const *data)
+{
+	proto_ldap_change_t const *change = data;
+
+	return fr_hash(change->uuid, sizeof(change->uuid));
+}
+
+static int proto_ldap_change_cmp(void const *one, void const *two)
+{
+	proto_ldap_change_t const *a = one, *b = two;
+
+	return memcmp(a->uuid, b->uuid, sizeof(a->uuid));
+}
+
+/** Wake up the listener so it can enqueue ready changes, or store a cookie
+ *
+ * @param[in] inst	of proto_ldap_sync.
+ */
+static void proto_ldap_notify(proto_ldap_inst_t *inst)
+{
+	/*
+	 *	The pipe is non-blocking.  If it's full, the
+	 *	listener already has a wakeup pending.
+	 */
+	if ((write(inst->notify_fd[1], "\0", 1) < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+		ERROR("Failed notifying listener: %s", fr_syserror(errno));
+	}
+}
+
+/** Record that processing of a change has completed
+ *
+ * Called by the worker.  Releases the next change to the same entry, and
+ * wakes up the listener if that change can be enqueued, or the cookie
+ * covering the change can now be stored.
+ *
+ * @param[in] request	which has completed.
+ */
+static void proto_ldap_change_done(REQUEST *request)
+{
+	proto_ldap_change_t	*change;
+	proto_ldap_inst_t	*inst;
+	bool			notify = false;
+
+	change = request_data_get(request, &proto_ldap_sync, 0);
+	if (!change) return;
+	inst = change->inst;
+
+	pthread_mutex_lock(&inst->mutex);
+	if (change->cookie) {
+		rad_assert(inst->checkpoint == CHECKPOINT_STORING);
+		rad_assert(inst->stores > 0);
+
+		if (--inst->stores == 0) {
+			inst->checkpoint = CHECKPOINT_IDLE;
+			notify = true;
+		}
+	} else {
+		if (change->keyed) {
+			proto_ldap_change_t *next = change->next;
+
+			if (next) {
+				fr_hash_table_replace(inst->in_flight, next);
+				next->ready_next = inst->ready;
+				inst->ready = next;
+				notify = true;
+			} else {
+				fr_hash_table_delete(inst->in_flight, change);
+			}
+		}
+
+		rad_assert(inst->outstanding[change->epoch] > 0);
+		if ((--inst->outstanding[change->epoch] == 0) &&
+		    (inst->checkpoint == CHECKPOINT_DRAINING) && (change->epoch != inst->epoch)) notify = true;
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	if (notify) proto_ldap_notify(inst);
+}
+
 /** Very simple state machine to process requests
  *
  * Unlike normal protocol requests which may have multiple distinct states,
@@ -398,6 +553,7 @@ static void request_running(REQUEST *request, fr_state_action_t action)
 			break;
 		}
 		rad_assert(request->log.unlang_indent == 0);
+		proto_ldap_change_done(request);
 		request_delete(request);
 		break;
 	}
@@ -428,6 +584,7 @@ static void request_queued(REQUEST *request, fr_state_action_t action)
 
 	case FR_ACTION_DONE:
 		(void) fr_heap_extract(request->backlog, request);
+		proto_ldap_change_done(request);
 		request_delete(request);
 		break;
 
@@ -507,6 +664,272 @@ static int proto_ldap_attributes_add(REQUEST *request, sync_config_t const *conf
 	return 0;
 }
 
+/** Enqueue a request processing a change
+ *
+ * The change is counted against the current epoch, so the next cookie isn't
+ * stored until it's been processed.  If an earlier change to the same entry
+ * is still being processed, the request waits for it to complete.
+ *
+ * @param[in] inst	of proto_ldap_sync.
+ * @param[in] request	processing the change.
+ * @param[in] uuid	of the entry.  NULL if the request isn't for a single entry.
+ */
+static void proto_ldap_change_enqueue(proto_ldap_inst_t *inst, REQUEST *request,
+				      uint8_t const uuid[SYNC_UUID_LENGTH])
+{
+	proto_ldap_change_t	*change, *head;
+
+	MEM(change = talloc_zero(request, proto_ldap_change_t));
+	change->inst = inst;
+	change->request = request;
+	if (uuid) {
+		memcpy(change->uuid, uuid, sizeof(change->uuid));
+		change->keyed = true;
+	}
+	request_data_add(request, &proto_ldap_sync, 0, change, false, false, false);
+
+	inst->changes++;
+
+	pthread_mutex_lock(&inst->mutex);
+	change->epoch = inst->epoch;
+	inst->outstanding[change->epoch]++;
+
+	if (change->keyed) {
+		head = fr_hash_table_finddata(inst->in_flight, change);
+		if (head) {
+			while (head->next) head = head->next;
+			head->next = change;
+			pthread_mutex_unlock(&inst->mutex);
+
+			RDEBUG2("Waiting for an earlier change to the entry to be processed");
+			return;
+		}
+		fr_hash_table_insert(inst->in_flight, change);
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	request_enqueue(request);
+}
+
+/** Enqueue the request containing the batch of present entries
+ *
+ * @param[in] inst	of proto_ldap_sync.
+ */
+static void proto_ldap_present_flush(proto_ldap_inst_t *inst)
+{
+	if (!inst->present) return;
+
+	proto_ldap_change_enqueue(inst, inst->present, NULL);
+
+	inst->present = NULL;
+	inst->present_config = NULL;
+	inst->present_count = 0;
+}
+
+/** Add an entry to the batch of present entries
+ *
+ * During the refresh phase of a sync, the server sends the UUID of every
+ * entry which hasn't changed.  Rather than creating a request for each one,
+ * we add a LDAP-Sync-Entry-UUID (and LDAP-Sync-Entry-DN if we have it) for
+ * up to present_batch entries to the same request.
+ *
+ * @param[in] listen	The common listener encapsulating the libldap fd.
+ * @param[in] conn	the sync belongs to.
+ * @param[in] config	of the sync that received an entry.
+ * @param[in] sync_id	of the sync that received an entry.
+ * @param[in] uuid	of the entry.
+ * @param[in] msg	containing the entry.  May be NULL.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int proto_ldap_present_add(rad_listen_t *listen, fr_ldap_conn_t *conn, sync_config_t const *config,
+				  int sync_id, uint8_t const uuid[SYNC_UUID_LENGTH], LDAPMessage *msg)
+{
+	proto_ldap_inst_t	*inst = talloc_get_type_abort(listen->data, proto_ldap_inst_t);
+	REQUEST			*request;
+	VALUE_PAIR		*vp;
+
+	if (inst->present && (inst->present_config != config)) proto_ldap_present_flush(inst);
+
+	if (!inst->present) {
+		request = proto_ldap_request_setup(listen, inst, sync_id);
+		if (!request) return -1;
+
+		proto_ldap_attributes_add(request, config);
+		request->packet->code = LDAP_SYNC_CODE_PRESENT;
+
+		inst->present = request;
+		inst->present_config = config;
+	}
+	request = inst->present;
+
+	vp = pair_make_request("LDAP-Sync-Entry-UUID", NULL, T_OP_ADD);
+	fr_pair_value_memcpy(vp, uuid, SYNC_UUID_LENGTH);
+
+	if (msg) {
+		char *entry_dn;
+
+		entry_dn = ldap_get_dn(conn->handle, msg);
+		pair_make_request("LDAP-Sync-Entry-DN", entry_dn, T_OP_ADD);
+		ldap_memfree(entry_dn);
+	}
+
+	if (++inst->present_count >= inst->present_batch) proto_ldap_present_flush(inst);
+
+	return 0;
+}
+
+/** Enqueue requests to store the cookies waiting to be checkpointed
+ *
+ * Called by the listener once all changes received before the cookies have
+ * been processed.
+ *
+ * @param[in] listen	The common listener encapsulating the libldap fd.
+ */
+static void proto_ldap_checkpoint_store(rad_listen_t *listen)
+{
+	proto_ldap_inst_t	*inst = talloc_get_type_abort(listen->data, proto_ldap_inst_t);
+	size_t			i, num = talloc_array_length(inst->sync_config);
+	uint32_t		stores = 0;
+
+	for (i = 0; i < num; i++) if (inst->cookies[i].checkpoint) stores++;
+
+	/*
+	 *	Set the count before enqueuing anything, so the
+	 *	checkpoint doesn't complete early.
+	 */
+	pthread_mutex_lock(&inst->mutex);
+	rad_assert(inst->checkpoint == CHECKPOINT_STORING);
+	inst->stores = stores;
+	if (!stores) inst->checkpoint = CHECKPOINT_IDLE;
+	pthread_mutex_unlock(&inst->mutex);
+
+	for (i = 0; i < num; i++) {
+		proto_ldap_cookie_t	*cookie = &inst->cookies[i];
+		proto_ldap_change_t	*change;
+		REQUEST			*request;
+		VALUE_PAIR		*vp;
+
+		if (!cookie->checkpoint) continue;
+
+		request = proto_ldap_request_setup(listen, inst, cookie->sync_id);
+		if (!request) {
+			ERROR("Failed allocating cookie store request");
+			TALLOC_FREE(cookie->checkpoint);
+
+			pthread_mutex_lock(&inst->mutex);
+			if (--inst->stores == 0) inst->checkpoint = CHECKPOINT_IDLE;
+			pthread_mutex_unlock(&inst->mutex);
+			continue;
+		}
+
+		proto_ldap_attributes_add(request, inst->sync_config[i]);
+
+		vp = pair_make_request("LDAP-Sync-Cookie", NULL, T_OP_SET);
+		fr_pair_value_memcpy(vp, cookie->checkpoint, talloc_array_length(cookie->checkpoint));
+		TALLOC_FREE(cookie->checkpoint);
+
+		request->packet->code = LDAP_SYNC_CODE_COOKIE_STORE;
+
+		MEM(change = talloc_zero(request, proto_ldap_change_t));
+		change->inst = inst;
+		change->request = request;
+		change->cookie = true;
+		request_data_add(request, &proto_ldap_sync, 0, change, false, false, false);
+
+		request_enqueue(request);
+	}
+}
+
+/** Start a checkpoint if enough changes have been received
+ *
+ * The latest cookie for each sync is set aside, and new changes are counted
+ * in the other epoch.  Once all the changes in the previous epoch have been
+ * processed, the cookies are stored.  Only one checkpoint is in progress at
+ * a time, so cookies are always stored in the order they were received.
+ *
+ * @param[in] listen	The common listener encapsulating the libldap fd.
+ */
+static void proto_ldap_checkpoint_start(rad_listen_t *listen)
+{
+	proto_ldap_inst_t	*inst = talloc_get_type_abort(listen->data, proto_ldap_inst_t);
+	size_t			i, num = talloc_array_length(inst->sync_config);
+	bool			found = false, drained;
+	int			old;
+
+	if (!inst->checkpoint_now && (inst->changes < inst->cookie_interval)) return;
+
+	for (i = 0; i < num; i++) if (inst->cookies[i].latest) found = true;
+	if (!found) return;
+
+	pthread_mutex_lock(&inst->mutex);
+	if (inst->checkpoint != CHECKPOINT_IDLE) {
+		pthread_mutex_unlock(&inst->mutex);
+		return;
+	}
+
+	old = inst->epoch;
+	inst->epoch ^= 1;
+	drained = (inst->outstanding[old] == 0);
+	inst->checkpoint = drained ? CHECKPOINT_STORING : CHECKPOINT_DRAINING;
+	pthread_mutex_unlock(&inst->mutex);
+
+	for (i = 0; i < num; i++) {
+		if (!inst->cookies[i].latest) continue;
+
+		inst->cookies[i].checkpoint = inst->cookies[i].latest;
+		inst->cookies[i].latest = NULL;
+	}
+	inst->changes = 0;
+	inst->checkpoint_now = false;
+
+	if (drained) proto_ldap_checkpoint_store(listen);
+}
+
+/** Enqueue changes which were waiting for earlier changes, and continue any checkpoint
+ *
+ * Called when a worker writes to the notification pipe.
+ *
+ * @param[in] el	the event list managing listen event.
+ * @param[in] fd	the notification pipe.
+ * @param[in] flags	from kevent.
+ * @param[in] uctx	The listener.
+ */
+static void proto_ldap_notify_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	rad_listen_t		*listen = talloc_get_type_abort(uctx, rad_listen_t);
+	proto_ldap_inst_t	*inst = talloc_get_type_abort(listen->data, proto_ldap_inst_t);
+	proto_ldap_change_t	*ready, *next;
+	uint8_t			buffer[64];
+	bool			store = false;
+
+	while (read(fd, buffer, sizeof(buffer)) > 0);
+
+	pthread_mutex_lock(&inst->mutex);
+	ready = inst->ready;
+	inst->ready = NULL;
+
+	if ((inst->checkpoint == CHECKPOINT_DRAINING) && (inst->outstanding[inst->epoch ^ 1] == 0)) {
+		inst->checkpoint = CHECKPOINT_STORING;
+		store = true;
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	for (; ready; ready = next) {
+		next = ready->ready_next;
+		ready->ready_next = NULL;
+		request_enqueue(ready->request);
+	}
+
+	if (store) {
+		proto_ldap_checkpoint_store(listen);
+		return;
+	}
+
+	proto_ldap_checkpoint_start(listen);
+}
+
 /** Attempt to reinitialise a sync
  *
  * It's perfectly fine to re-initialise individual sync without tearing down the
@@ -611,11 +1034,44 @@ static int _proto_ldap_present(fr_ldap_conn_t *conn, sync_config_t const *config
 	return 0;
 }
 
-/** Enque a new cookie store request
+/** Receive notification that the refresh phase is complete
+ *
+ * Stores the cookie covering the refresh as soon as possible, regardless of
+ * cookie_interval, so a restart doesn't repeat the refresh.
+ *
+ * @note This is a callback for the sync_demux function.
+ *
+ * @param[in] conn	the sync belongs to.
+ * @param[in] config	of the sync that completed the refresh phase.
+ * @param[in] sync_id	of the sync that completed the refresh phase.
+ * @param[in] phase	Refresh phase the sync was previously in.
+ * @param[in] user_ctx	The listener.
+ * @return 0.
+ */
+static int _proto_ldap_refresh_done(UNUSED fr_ldap_conn_t *conn, UNUSED sync_config_t const *config,
+				    UNUSED int sync_id, UNUSED sync_phases_t phase, void *user_ctx)
+{
+	rad_listen_t		*listen = talloc_get_type_abort(user_ctx, rad_listen_t);
+	proto_ldap_inst_t	*inst = talloc_get_type_abort(listen->data, proto_ldap_inst_t);
+
+	proto_ldap_present_flush(inst);
+
+	/*
+	 *	The cookie for the refresh is passed to us after
+	 *	this callback, so the checkpoint is started once
+	 *	all the messages have been read.
+	 */
+	inst->checkpoint_now = true;
+
+	return 0;
+}
+
+/** Record a new cookie
  *
- * Create a new request containing the cookie we received from the LDAP server. This allows
- * the administrator to store the cookie and provide it on a future call to
- * #proto_ldap_cookie_load.
+ * The cookie is stored by a request containing the cookie we received from the LDAP
+ * server, once all the changes it covers have been processed, and at least cookie_interval
+ * changes have been received.  This allows the administrator to store the cookie and provide
+ * it on a future call to #proto_ldap_cookie_load.
  *
  * @note This is a callback for the sync_demux function.
  *
@@ -633,22 +1089,19 @@ static int _proto_ldap_cookie_store(UNUSED fr_ldap_conn_t *conn, sync_config_t c
 {
 	rad_listen_t		*listen = talloc_get_type_abort(user_ctx, rad_listen_t);
 	proto_ldap_inst_t	*inst = talloc_get_type_abort(listen->data, proto_ldap_inst_t);
-	REQUEST			*request;
-	VALUE_PAIR		*vp;
-
-	request = proto_ldap_request_setup(listen, inst, sync_id);
-	if (!request) return -1;
-
-	proto_ldap_attributes_add(request, config);
+	size_t			i;
 
-	vp = pair_make_request("LDAP-Sync-Cookie", NULL, T_OP_SET);
-	fr_pair_value_memcpy(vp, cookie, talloc_array_length(cookie));
+	for (i = 0; i < talloc_array_length(inst->sync_config); i++) {
+		if (inst->sync_config[i] != config) continue;
 
-	request->packet->code = LDAP_SYNC_CODE_COOKIE_STORE;
+		talloc_free(inst->cookies[i].latest);
+		MEM(inst->cookies[i].latest = talloc_memdup(inst->cookies, cookie, talloc_array_length(cookie)));
+		inst->cookies[i].sync_id = sync_id;
 
-	request_enqueue(request);
+		return 0;
+	}
 
-	return 0;
+	return -1;
 }
 
 /** Process an entry modification operation
@@ -677,6 +1130,17 @@ static int _proto_ldap_entry(fr_ldap_conn_t *conn, sync_config_t const *config,
 	proto_ldap_inst_t	*inst = talloc_get_type_abort(listen->data, proto_ldap_inst_t);
 	fr_ldap_map_exp_t	expanded;
 	REQUEST			*request;
+	VALUE_PAIR		*vp;
+
+	if ((state == SYNC_STATE_PRESENT) && (inst->present_batch > 1)) {
+		return proto_ldap_present_add(listen, conn, config, sync_id, uuid, msg);
+	}
+
+	/*
+	 *	Present entries are enqueued before any other
+	 *	change, in case the change is to one of them.
+	 */
+	proto_ldap_present_flush(inst);
 
 	request = proto_ldap_request_setup(listen, inst, sync_id);
 	if (!request) return -1;
@@ -689,16 +1153,15 @@ static int _proto_ldap_entry(fr_ldap_conn_t *conn, sync_config_t const *config,
 	 */
 	if (msg) {
 		char *entry_dn;
-		VALUE_PAIR *vp;
 
 		entry_dn = ldap_get_dn(conn->handle, msg);
 		pair_make_request("LDAP-Sync-Entry-DN", entry_dn, T_OP_SET);
 		ldap_memfree(entry_dn);
-
-		vp = pair_make_request("LDAP-Sync-Entry-UUID", NULL, T_OP_SET);
-		fr_pair_value_memcpy(vp, uuid, SYNC_UUID_LENGTH);
 	}
 
+	vp = pair_make_request("LDAP-Sync-Entry-UUID", NULL, T_OP_SET);
+	fr_pair_value_memcpy(vp, uuid, SYNC_UUID_LENGTH);
+
 	/*
 	 *	Apply the attribute map
 	 */
@@ -709,7 +1172,7 @@ static int _proto_ldap_entry(fr_ldap_conn_t *conn, sync_config_t const *config,
 	}
 	if (fr_ldap_map_do(request, conn, NULL, &expanded, msg) < 0) goto error;
 
-	request_enqueue(request);
+	proto_ldap_change_enqueue(inst, request, uuid);
 
 	return 0;
 }
@@ -842,13 +1305,13 @@ finish:
  *					phase (which we don't allow).
  *	- _proto_ldap_refresh_required	The server wants us to download all content
  *					specified by our sync/search.
+ *	- _proto_ldap_refresh_done	The refresh phase is complete.
  *
  * These callbacks may result in requests being enqueued or syncs restarted.
  *
- * @note We do not currently make enqueuing the cookie requests dependent on all
- *	previous LDAP entries being processed, so we may miss updates in some
- *	circumstances.  This needs to be fixed, but is waiting on v4.0.0
- *	re-architecture.
+ * Once the messages have been drained, any batch of present entries is enqueued,
+ * and a checkpoint is started if enough changes have been received.  Cookies are
+ * only stored once all the changes received before them have been processed.
  *
  * @param[in] listen	encapsulating the libldap socket.
  * @return
@@ -872,6 +1335,8 @@ static int proto_ldap_socket_recv(rad_listen_t *listen)
 	 */
  	switch (sync_demux(&sync_id, inst->conn)) {
  	default:
+		proto_ldap_present_flush(inst);
+		proto_ldap_checkpoint_start(listen);
 		return 1;
 
  	case -1:
@@ -934,6 +1399,33 @@ static int proto_ldap_socket_open(UNUSED CONF_SECTION *cs, rad_listen_t *listen)
 	 */
 	inst->el = process_global_event_list(0);
 
+	/*
+	 *	Workers write to this pipe when a change completes,
+	 *	so the listener can enqueue the next change to the
+	 *	same entry, or store a cookie.
+	 */
+	if (inst->notify_fd[0] < 0) {
+		if (pipe(inst->notify_fd) < 0) {
+			ERROR("Failed creating notification pipe: %s", fr_syserror(errno));
+			return -1;
+		}
+
+		if ((fr_nonblock(inst->notify_fd[0]) < 0) || (fr_nonblock(inst->notify_fd[1]) < 0)) {
+			ERROR("Failed setting notification pipe to non-blocking: %s", fr_syserror(errno));
+		close_pipe:
+			close(inst->notify_fd[0]);
+			close(inst->notify_fd[1]);
+			inst->notify_fd[0] = inst->notify_fd[1] = -1;
+			return -1;
+		}
+
+		if (fr_event_fd_insert(inst, inst->el, inst->notify_fd[0],
+				       proto_ldap_notify_read, NULL, NULL, listen) < 0) {
+			PERROR("Failed inserting notification pipe");
+			goto close_pipe;
+		}
+	}
+
 	/*
 	 *	Destroys any existing syncs and connections
 	 */
@@ -1062,6 +1554,20 @@ static int proto_ldap_socket_parse(CONF_SECTION *cs, rad_listen_t *listen)
 
 	talloc_set_type(inst, proto_ldap_inst_t);
 
+	FR_INTEGER_BOUND_CHECK("cookie_interval", inst->cookie_interval, >=, 1);
+	FR_INTEGER_BOUND_CHECK("present_batch", inst->present_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("present_batch", inst->present_batch, <=, 10000);
+
+	pthread_mutex_init(&inst->mutex, NULL);
+	inst->in_flight = fr_hash_table_create(inst, proto_ldap_change_hash, proto_ldap_change_cmp, NULL);
+	if (!inst->in_flight) {
+		cf_log_err(cs, "Failed creating change table");
+		return -1;
+	}
+	inst->notify_fd[0] = inst->notify_fd[1] = -1;
+
+	MEM(inst->cookies = talloc_zero_array(inst, proto_ldap_cookie_t, talloc_array_length(inst->sync_config)));
+
 	rad_assert(inst->handle_config.server_str[0]);
 	inst->handle_config.name = talloc_asprintf(inst, "proto_ldap_conn (%s)", listen->server);
 
@@ -1107,6 +1613,7 @@ static int proto_ldap_socket_parse(CONF_SECTION *cs, rad_listen_t *listen)
 		inst->sync_config[i]->entry = _proto_ldap_entry;
 		inst->sync_config[i]->refresh_required = _proto_ldap_refresh_required;
 		inst->sync_config[i]->present = _proto_ldap_present;
+		inst->sync_config[i]->done = _proto_ldap_refresh_done;
 
 		/*
 		 *	Parse and validate any maps
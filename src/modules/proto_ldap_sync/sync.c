@@ -536,10 +536,16 @@ static int sync_intermediate(sync_state_t *sync, LDAPMessage *msg, UNUSED LDAPCo
 				goto error;
 			}
 
+			/*
+			 *	A syncIdSet lists either the entries which
+			 *	are still present, or the entries which were
+			 *	deleted, depending on refreshDeletes.
+			 */
 			ret = sync->config->entry(sync->conn, sync->config, sync->msgid, sync->phase,
-						  (uint8_t const *)sync_uuids[i].bv_val, NULL, SYNC_STATE_DELETE,
+						  (uint8_t const *)sync_uuids[i].bv_val, NULL,
+						  refresh_deletes ? SYNC_STATE_DELETE : SYNC_STATE_PRESENT,
 						  sync->config->user_ctx);
-			if (!ret) goto error;
+			if (ret < 0) goto error;
 		}
 
 		ber_bvarray_free(sync_uuids);
@@ -1 +1 @@
-SUBMAKEFILES := proto_radius.mk proto_radius_udp.mk proto_radius_acct.mk proto_radius_auth.mk proto_radius_coa.mk proto_radius_status.mk
+SUBMAKEFILES := proto_radius.mk proto_radius_udp.mk proto_radius_tcp.mk proto_radius_detail.mk proto_radius_acct.mk proto_radius_auth.mk proto_radius_coa.mk proto_radius_status.mk
@@ -23,10 +23,12 @@
  * @copyright 2016 Alan DeKok (aland@freeradius.org)
  */
 #include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
 #include <freeradius-devel/radius/radius.h>
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/io/schedule.h>
 #include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/metrics.h>
 #include <freeradius-devel/rad_assert.h>
 #include "proto_radius.h"
 
@@ -34,6 +36,28 @@ extern fr_app_t proto_radius;
 static int process_parse(TALLOC_CTX *ctx, void *out, CONF_ITEM *ci, CONF_PARSER const *rule);
 static int transport_parse(TALLOC_CTX *ctx, void *out, CONF_ITEM *ci, CONF_PARSER const *rule);
 
+/** How long packets of each priority are useful for
+ *
+ */
+static CONF_PARSER const deadline_config[] = {
+	{ FR_CONF_OFFSET("high", FR_TYPE_TIMEVAL, proto_radius_t, deadline[FR_IO_PRIORITY_HIGH]) },
+	{ FR_CONF_OFFSET("normal", FR_TYPE_TIMEVAL, proto_radius_t, deadline[FR_IO_PRIORITY_NORMAL]) },
+	{ FR_CONF_OFFSET("low", FR_TYPE_TIMEVAL, proto_radius_t, deadline[FR_IO_PRIORITY_LOW]) },
+	{ FR_CONF_OFFSET("background", FR_TYPE_TIMEVAL, proto_radius_t, deadline[FR_IO_PRIORITY_BACKGROUND]) },
+
+	CONF_PARSER_TERMINATOR
+};
+
+/** Where to mirror sampled packets
+ *
+ */
+static CONF_PARSER const mirror_config[] = {
+	{ FR_CONF_OFFSET("virtual_server", FR_TYPE_STRING, proto_radius_t, mirror_server) },
+	{ FR_CONF_OFFSET("sample", FR_TYPE_UINT32, proto_radius_t, mirror_sample), .dflt = "100" },
+
+	CONF_PARSER_TERMINATOR
+};
+
 /** How to parse a RADIUS listen section
  *
  */
@@ -43,6 +67,11 @@ static CONF_PARSER const proto_radius_config[] = {
 	{ FR_CONF_OFFSET("transport", FR_TYPE_VOID, proto_radius_t, io_submodule),
 	  .func = transport_parse },
 
+	{ FR_CONF_POINTER("deadline", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) deadline_config },
+	{ FR_CONF_POINTER("mirror", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) mirror_config },
+
+	{ FR_CONF_OFFSET("lazy_decode", FR_TYPE_BOOL, proto_radius_t, lazy_decode), .dflt = "no" },
+
 	/*
 	 *	For performance tweaking.  NOT for normal humans.
 	 */
@@ -161,6 +190,150 @@ static int transport_parse(TALLOC_CTX *ctx, void *out, CONF_ITEM *ci, UNUSED CON
 	return dl_instance(ctx, out, transport_cs, parent_inst, name, DL_TYPE_SUBMODULE);
 }
 
+/** Return the priority of a raw packet
+ *
+ *  Status-Server is always answered, so that clients don't mark us
+ *  as dead when we're busy.  Authentication is more important than
+ *  accounting, and accounting interim updates are the first to go, as
+ *  the next one carries the same information.
+ */
+static fr_io_priority_t mod_priority(void const *instance, uint8_t const *data, size_t data_len)
+{
+	proto_radius_t const *inst = talloc_get_type_abort(instance, proto_radius_t);
+	uint8_t const *p, *end;
+
+	/*
+	 *	Records from a file, which aren't RADIUS packets.
+	 *	Nothing is waiting for the replies.
+	 */
+	if (inst->app_io_private->decode) return FR_IO_PRIORITY_LOW;
+
+	if (data_len < 20) return FR_IO_PRIORITY_NORMAL;
+
+	switch (data[0]) {
+	case FR_CODE_STATUS_SERVER:
+		return FR_IO_PRIORITY_HIGH;
+
+	case FR_CODE_ACCOUNTING_REQUEST:
+		break;
+
+	default:
+		return FR_IO_PRIORITY_NORMAL;
+	}
+
+	/*
+	 *	Look for Acct-Status-Type.  The packet hasn't been
+	 *	verified yet, so be careful with the lengths.
+	 */
+	p = data + 20;
+	end = data + data_len;
+
+	while ((p + 2) <= end) {
+		if (p[1] < 2) break;
+		if ((p + p[1]) > end) break;
+
+		if ((p[0] == FR_ACCT_STATUS_TYPE) && (p[1] == 6)) {
+			if ((p[2] == 0) && (p[3] == 0) && (p[4] == 0) &&
+			    (p[5] == FR_ACCT_STATUS_TYPE_VALUE_INTERIM_UPDATE)) return FR_IO_PRIORITY_BACKGROUND;
+			break;
+		}
+
+		p += p[1];
+	}
+
+	return FR_IO_PRIORITY_LOW;
+}
+
+/*
+ *	Counters for each client.  Many workers read packets from the
+ *	same client, so the counters are shared.
+ */
+typedef enum {
+	CLIENT_METRIC_INVALID = 0,
+	CLIENT_METRIC_ACCESS_REQUEST,
+	CLIENT_METRIC_ACCOUNTING_REQUEST,
+	CLIENT_METRIC_COA_REQUEST,
+	CLIENT_METRIC_DISCONNECT_REQUEST,
+	CLIENT_METRIC_STATUS_SERVER,
+	CLIENT_METRIC_ACCESS_ACCEPT,
+	CLIENT_METRIC_ACCESS_REJECT,
+	CLIENT_METRIC_ACCESS_CHALLENGE,
+	CLIENT_METRIC_ACCOUNTING_RESPONSE,
+	CLIENT_METRIC_COA_ACK,
+	CLIENT_METRIC_COA_NAK,
+	CLIENT_METRIC_DISCONNECT_ACK,
+	CLIENT_METRIC_DISCONNECT_NAK,
+	CLIENT_METRIC_MAX
+} proto_radius_client_metric_t;
+
+#define CLIENT_REQUEST(_code) { "freeradius_client_requests", "code=\"" _code "\"", FR_METRIC_COUNTER, \
+				"Requests received from the client." }
+#define CLIENT_RESPONSE(_code) { "freeradius_client_responses", "code=\"" _code "\"", FR_METRIC_COUNTER, \
+				 "Responses sent to the client." }
+
+static fr_metric_t const client_metrics[CLIENT_METRIC_MAX] = {
+	[CLIENT_METRIC_INVALID] = { "freeradius_client_invalid_requests", NULL, FR_METRIC_COUNTER,
+				    "Requests from the client which couldn't be decoded." },
+	[CLIENT_METRIC_ACCESS_REQUEST]		= CLIENT_REQUEST("Access-Request"),
+	[CLIENT_METRIC_ACCOUNTING_REQUEST]	= CLIENT_REQUEST("Accounting-Request"),
+	[CLIENT_METRIC_COA_REQUEST]		= CLIENT_REQUEST("CoA-Request"),
+	[CLIENT_METRIC_DISCONNECT_REQUEST]	= CLIENT_REQUEST("Disconnect-Request"),
+	[CLIENT_METRIC_STATUS_SERVER]		= CLIENT_REQUEST("Status-Server"),
+	[CLIENT_METRIC_ACCESS_ACCEPT]		= CLIENT_RESPONSE("Access-Accept"),
+	[CLIENT_METRIC_ACCESS_REJECT]		= CLIENT_RESPONSE("Access-Reject"),
+	[CLIENT_METRIC_ACCESS_CHALLENGE]	= CLIENT_RESPONSE("Access-Challenge"),
+	[CLIENT_METRIC_ACCOUNTING_RESPONSE]	= CLIENT_RESPONSE("Accounting-Response"),
+	[CLIENT_METRIC_COA_ACK]			= CLIENT_RESPONSE("CoA-ACK"),
+	[CLIENT_METRIC_COA_NAK]			= CLIENT_RESPONSE("CoA-NAK"),
+	[CLIENT_METRIC_DISCONNECT_ACK]		= CLIENT_RESPONSE("Disconnect-ACK"),
+	[CLIENT_METRIC_DISCONNECT_NAK]		= CLIENT_RESPONSE("Disconnect-NAK"),
+};
+
+/*
+ *	Which counter each packet code uses, or 0 for "not counted".
+ */
+static uint8_t const client_metric_index[FR_MAX_PACKET_CODE] = {
+	[FR_CODE_ACCESS_REQUEST]	= CLIENT_METRIC_ACCESS_REQUEST,
+	[FR_CODE_ACCOUNTING_REQUEST]	= CLIENT_METRIC_ACCOUNTING_REQUEST,
+	[FR_CODE_COA_REQUEST]		= CLIENT_METRIC_COA_REQUEST,
+	[FR_CODE_DISCONNECT_REQUEST]	= CLIENT_METRIC_DISCONNECT_REQUEST,
+	[FR_CODE_STATUS_SERVER]		= CLIENT_METRIC_STATUS_SERVER,
+	[FR_CODE_ACCESS_ACCEPT]		= CLIENT_METRIC_ACCESS_ACCEPT,
+	[FR_CODE_ACCESS_REJECT]		= CLIENT_METRIC_ACCESS_REJECT,
+	[FR_CODE_ACCESS_CHALLENGE]	= CLIENT_METRIC_ACCESS_CHALLENGE,
+	[FR_CODE_ACCOUNTING_RESPONSE]	= CLIENT_METRIC_ACCOUNTING_RESPONSE,
+	[FR_CODE_COA_ACK]		= CLIENT_METRIC_COA_ACK,
+	[FR_CODE_COA_NAK]		= CLIENT_METRIC_COA_NAK,
+	[FR_CODE_DISCONNECT_ACK]	= CLIENT_METRIC_DISCONNECT_ACK,
+	[FR_CODE_DISCONNECT_NAK]	= CLIENT_METRIC_DISCONNECT_NAK,
+};
+
+/** Count a packet from, or to a client
+ *
+ * Mirrored copies aren't counted, as the original already was.
+ *
+ * @param[in] request	the packet belongs to.
+ * @param[in] client	the packet is from, or to.
+ * @param[in] metric	to increment, or CLIENT_METRIC_MAX to use the packet code.
+ * @param[in] code	of the packet.
+ */
+static void mod_client_count(REQUEST *request, RADCLIENT *client, proto_radius_client_metric_t metric,
+			     unsigned int code)
+{
+	fr_metric_set_t *ms;
+
+	if (request->async->listen && request->async->listen->shadow) return;
+
+	if (metric == CLIENT_METRIC_MAX) {
+		if ((code >= FR_MAX_PACKET_CODE) || !client_metric_index[code]) return;
+		metric = client_metric_index[code];
+	}
+
+	ms = fr_metric_set_once(&client->metrics, client, client_metrics, CLIENT_METRIC_MAX, "client",
+				client->shortname ? client->shortname : client->longname);
+	if (ms) fr_metric_inc(ms, metric);
+}
+
 /** Decode the packet, and set the request->process function
  *
  */
@@ -169,6 +342,14 @@ static int mod_decode(void const *instance, REQUEST *request, uint8_t *const dat
 	proto_radius_t const *inst = talloc_get_type_abort(instance, proto_radius_t);
 	RADCLIENT *client;
 
+	/*
+	 *	The transport reads something other than RADIUS
+	 *	packets, and populates the request itself.
+	 */
+	if (inst->app_io_private->decode) {
+		return inst->app_io_private->decode(inst->app_io_instance, request, data, data_len);
+	}
+
 	rad_assert(data[0] < FR_MAX_PACKET_CODE);
 
 	client = inst->app_io_private->client(inst->app_io, request->async->packet_ctx);
@@ -182,14 +363,38 @@ static int mod_decode(void const *instance, REQUEST *request, uint8_t *const dat
 	request->reply->id = data[1];
 	memcpy(request->packet->vector, data + 4, sizeof(request->packet->vector));
 
-	request->packet->data = talloc_memdup(request->packet, data, data_len);
+	/*
+	 *	The worker holds the message until it's done with the
+	 *	request, so we can decode straight out of it.
+	 */
+	if (request->async->message) {
+		request->packet->data = data;
+	} else {
+		request->packet->data = talloc_memdup(request->packet, data, data_len);
+	}
 	request->packet->data_len = data_len;
 
-	if (fr_radius_packet_decode(request->packet, NULL, client->secret) < 0) {
+	/*
+	 *	VSAs in requests are only decoded when they're used.
+	 *	Access-Request packets are always decoded in full, as
+	 *	authentication modules such as mschap look for vendor
+	 *	attributes directly.
+	 */
+	if (inst->lazy_decode && (request->packet->code != FR_CODE_ACCESS_REQUEST)) {
+		if (fr_radius_packet_decode_lazy(request->packet, client->secret) < 0) {
+			RDEBUG("Failed decoding packet: %s", fr_strerror());
+			mod_client_count(request, client, CLIENT_METRIC_INVALID, 0);
+			return -1;
+		}
+
+	} else if (fr_radius_packet_decode(request->packet, NULL, client->secret) < 0) {
 		RDEBUG("Failed decoding packet: %s", fr_strerror());
+		mod_client_count(request, client, CLIENT_METRIC_INVALID, 0);
 		return -1;
 	}
 
+	mod_client_count(request, client, CLIENT_METRIC_MAX, request->packet->code);
+
 	/*
 	 *	Let the app_io take care of populating additional fields in the request
 	 */
@@ -221,6 +426,8 @@ static ssize_t mod_encode(void const *instance, REQUEST *request, uint8_t *buffe
 
 	memcpy(buffer, request->reply->data, len);
 
+	mod_client_count(request, client, CLIENT_METRIC_MAX, request->reply->code);
+
 	return len;
 }
 
@@ -232,7 +439,11 @@ static void mod_process_set(void const *instance, REQUEST *request)
 	rad_assert(request->packet->code != 0);
 	rad_assert(request->packet->code < FR_CODE_MAX);
 
-	request->server_cs = inst->server_cs;
+	/*
+	 *	Mirrored copies of our packets run in the mirror
+	 *	virtual server, which is the shadow listener's.
+	 */
+	request->server_cs = request->async->listen->server_cs;
 
 	process = inst->process_by_code[request->packet->code];
 	if (!process) {
@@ -243,19 +454,21 @@ static void mod_process_set(void const *instance, REQUEST *request)
 	request->async->process = process;
 }
 
-/** Open listen sockets/connect to external event source
+/** Open one socket, and add it to the scheduler
  *
- * @param[in] instance	Ctx data for this application.
- * @param[in] sc	to add our file descriptor to.
- * @param[in] conf	Listen section parsed to give us isntance.
+ * @param[in] inst		Ctx data for this application.
+ * @param[in] sc		to add our file descriptor to.
+ * @param[in] conf		Listen section parsed to give us isntance.
+ * @param[in] app_io_instance	of the socket to open.
  * @return
- *	- 0 on success.
- *	- -1 on failure.
+ *	- the new listener on success.
+ *	- NULL on failure.
  */
-static int mod_open(void *instance, fr_schedule_t *sc, CONF_SECTION *conf)
+static fr_listen_t *mod_listen_open(proto_radius_t *inst, fr_schedule_t *sc, CONF_SECTION *conf,
+				    void *app_io_instance)
 {
+	int		i;
 	fr_listen_t	*listen;
-	proto_radius_t 	*inst = talloc_get_type_abort(instance, proto_radius_t);
 
 	/*
 	 *	Build the #fr_listen_t.  This describes the complete
@@ -265,36 +478,121 @@ static int mod_open(void *instance, fr_schedule_t *sc, CONF_SECTION *conf)
 	listen = talloc_zero(inst, fr_listen_t);
 
 	listen->app_io = inst->app_io;
-	listen->app_io_instance = inst->app_io_instance;
+	listen->app_io_instance = app_io_instance;
 
 	listen->app = &proto_radius;
-	listen->app_instance = instance;
+	listen->app_instance = inst;
 	listen->server_cs = inst->server_cs;
 
+	/*
+	 *	Name the listener for the metrics.  The port is
+	 *	enough to tell listeners apart in most configurations.
+	 */
+	{
+		CONF_PAIR *cp = inst->app_io_conf ? cf_pair_find(inst->app_io_conf, "port") : NULL;
+
+		if (cp && cf_pair_value(cp)) {
+			listen->name = talloc_typed_asprintf(listen, "%s/%s/%s", cf_section_name2(inst->server_cs),
+							     inst->app_io->name, cf_pair_value(cp));
+		} else {
+			listen->name = talloc_typed_asprintf(listen, "%s/%s", cf_section_name2(inst->server_cs),
+							     inst->app_io->name);
+		}
+	}
+
 	/*
 	 *	Set configurable parameters for message ring buffer.
 	 */
 	listen->default_message_size = inst->default_message_size;
-	listen->num_messages = inst->default_message_size;
+	listen->num_messages = inst->num_messages;
+
+	for (i = 0; i < FR_IO_PRIORITY_MAX; i++) {
+		listen->deadline[i] = (((fr_time_t) inst->deadline[i].tv_sec) * NANOSEC) +
+				      (((fr_time_t) inst->deadline[i].tv_usec) * 1000);
+	}
+
+	/*
+	 *	The shadow listener has no socket.  Its replies are
+	 *	discarded by the network thread.
+	 */
+	if (inst->mirror_server_cs) {
+		fr_listen_t *shadow;
+
+		shadow = talloc_zero(listen, fr_listen_t);
+		shadow->app_io = listen->app_io;
+		shadow->app_io_instance = listen->app_io_instance;
+		shadow->app = listen->app;
+		shadow->app_instance = listen->app_instance;
+		shadow->server_cs = inst->mirror_server_cs;
+		shadow->name = talloc_typed_asprintf(shadow, "%s/mirror", listen->name);
+		shadow->default_message_size = listen->default_message_size;
+		shadow->num_messages = listen->num_messages;
+		memcpy(shadow->deadline, listen->deadline, sizeof(shadow->deadline));
+		shadow->shadow = true;
+
+		listen->mirror = shadow;
+		listen->mirror_sample = inst->mirror_sample;
+	}
 
 	/*
 	 *	Open the socket, and add it to the scheduler.
 	 */
-	if (inst->app_io) {
-		if (inst->app_io->open(inst->app_io_instance) < 0) {
-			cf_log_err(conf, "Failed opening %s interface", inst->app_io->name);
-			talloc_free(listen);
-			return -1;
-		}
+	if (inst->app_io->open(app_io_instance) < 0) {
+		cf_log_err(conf, "Failed opening %s interface", inst->app_io->name);
+		talloc_free(listen);
+		return NULL;
+	}
 
-		if (!fr_schedule_socket_add(sc, listen)) {
-			talloc_free(listen);
-			return -1;
-		}
+	if (!fr_schedule_socket_add(sc, listen)) {
+		talloc_free(listen);
+		return NULL;
 	}
 
+	return listen;
+}
+
+/** Open listen sockets/connect to external event source
+ *
+ * If the I/O path can share its address between multiple sockets,
+ * we open one socket for each network thread.
+ *
+ * @param[in] instance	Ctx data for this application.
+ * @param[in] sc	to add our file descriptor to.
+ * @param[in] conf	Listen section parsed to give us isntance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_open(void *instance, fr_schedule_t *sc, CONF_SECTION *conf)
+{
+	int		i, num;
+	fr_listen_t	*listen;
+	proto_radius_t 	*inst = talloc_get_type_abort(instance, proto_radius_t);
+
+	if (!inst->app_io) return 0;
+
+	listen = mod_listen_open(inst, sc, conf, inst->app_io_instance);
+	if (!listen) return -1;
+
 	inst->listen = listen;	/* Probably won't need it, but doesn't hurt */
 
+	if (!inst->app_io->shard) return 0;
+
+	num = fr_schedule_num_networks(sc);
+	for (i = 1; i < num; i++) {
+		int		rcode;
+		void		*app_io_instance;
+
+		rcode = inst->app_io->shard(&app_io_instance, inst, inst->app_io_instance);
+		if (rcode < 0) {
+			cf_log_err(conf, "Failed creating %s interface: %s", inst->app_io->name, fr_strerror());
+			return -1;
+		}
+		if (rcode == 0) break;
+
+		if (!mod_listen_open(inst, sc, conf, app_io_instance)) return -1;
+	}
+
 	return 0;
 }
 
@@ -378,6 +676,44 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	FR_INTEGER_BOUND_CHECK("default_message_size", inst->default_message_size, >=, 1024);
 	FR_INTEGER_BOUND_CHECK("default_message_size", inst->default_message_size, <=, 65535);
 
+	if (inst->mirror_server) {
+		CONF_PAIR *cp_ns;
+
+		if (!inst->app_io || !inst->app_io->mirror) {
+			cf_log_err(conf, "Transport \"%s\" can't mirror packets",
+				   inst->app_io ? inst->app_io->name : "none");
+			return -1;
+		}
+
+		inst->mirror_server_cs = virtual_server_find(inst->mirror_server);
+		if (!inst->mirror_server_cs) {
+			cf_log_err(conf, "Unknown mirror virtual_server \"%s\"", inst->mirror_server);
+			return -1;
+		}
+
+		if (inst->mirror_server_cs == inst->server_cs) {
+			cf_log_err(conf, "Packets can't be mirrored to the virtual server which receives them");
+			return -1;
+		}
+
+		cp_ns = cf_pair_find(inst->mirror_server_cs, "namespace");
+		if (!cp_ns || (strcmp(cf_pair_value(cp_ns), "radius") != 0)) {
+			cf_log_err(conf, "Mirror virtual_server \"%s\" must have \"namespace = radius\"",
+				   inst->mirror_server);
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("sample", inst->mirror_sample, >=, 1);
+		FR_INTEGER_BOUND_CHECK("sample", inst->mirror_sample, <=, 1000000);
+	}
+
+	for (i = 0; i < FR_IO_PRIORITY_MAX; i++) {
+		if (!fr_timeval_isset(&inst->deadline[i])) continue;
+
+		FR_TIMEVAL_BOUND_CHECK("deadline", &inst->deadline[i], >=, 0, 10000);
+		FR_TIMEVAL_BOUND_CHECK("deadline", &inst->deadline[i], <=, 60, 0);
+	}
+
 	return 0;
 }
 
@@ -447,5 +783,6 @@ fr_app_t proto_radius = {
 	.open		= mod_open,
 	.decode		= mod_decode,
 	.encode		= mod_encode,
-	.process_set	= mod_process_set
+	.process_set	= mod_process_set,
+	.priority	= mod_priority
 };
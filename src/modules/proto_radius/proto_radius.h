@@ -43,6 +43,19 @@ typedef RADCLIENT *(*proto_radius_client_get_t)(void const *instance, void const
 typedef int (*proto_radius_addr_get_t)(fr_socket_addr_t *sockaddr,
 				       void const *instance, void const *packet_ctx);
 
+/** Decode data which isn't a RADIUS packet into the request
+ *
+ * @param[in] instance		#fr_app_io_t instance.
+ * @param[in] request		to populate.
+ * @param[in] data		as returned by the #fr_app_io_t read() callback.
+ * @param[in] data_len		of the data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+typedef int (*proto_radius_decode_t)(void const *instance, REQUEST *request,
+				     uint8_t *const data, size_t data_len);
+
 /** Semi-private functions exported by proto_radius #fr_app_io_t modules
  *
  * Should only be used by the proto_radius module, and submodules.
@@ -53,6 +66,10 @@ typedef struct {
 
 	proto_radius_addr_get_t		src;				//!< Retrieve the src address of the packet.
 	proto_radius_addr_get_t		dst;				//!< Retrieve the dst address of the packet.
+
+	proto_radius_decode_t		decode;				//!< Decode data which isn't a RADIUS packet.
+									///< If set, it's used instead of the RADIUS
+									///< decoder.
 } proto_radius_app_io_t;
 
 /** An instance of a proto_radius listen section
@@ -77,8 +94,19 @@ typedef struct {
 	uint32_t			default_message_size;		//!< for message ring buffer
 	uint32_t			num_messages;			//!< for message ring buffer
 
+	struct timeval			deadline[FR_IO_PRIORITY_MAX];	//!< How long packets of each priority
+									///< are useful for.  Unset for no deadline.
+
 	bool				code_allowed[FR_CODE_MAX];	//!< Lookup allowed packet codes.
 
+	bool				lazy_decode;			//!< Only decode VSAs in requests when
+									///< they're used.
+
+	char const			*mirror_server;			//!< Virtual server sampled packets are
+									///< mirrored to, or NULL.
+	CONF_SECTION			*mirror_server_cs;		//!< The mirror virtual server.
+	uint32_t			mirror_sample;			//!< One packet in this many is mirrored.
+
 	fr_listen_t const		*listen;			//!< The listener structure which describes
 									///< the I/O path.
 } proto_radius_t;
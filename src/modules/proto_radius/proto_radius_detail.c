@@ -0,0 +1,1311 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_radius_detail.c
+ * @brief RADIUS handler for detail files.
+ *
+ * The network thread maps the detail file into memory, and hands
+ * each record to a worker as a message.  The workers parse the
+ * records, so many records are processed at once.
+ *
+ * Records are acknowledged out of order.  We remember where the
+ * records which are still being processed start, and write the
+ * offset before which every record has been acknowledged to a small
+ * checkpoint file.  If the server is restarted, it carries on from
+ * there.
+ *
+ * @copyright 2026 The FreeRADIUS server project.
+ */
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/protocol.h>
+#include <freeradius-devel/radius/radius.h>
+#include <freeradius-devel/io/io.h>
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/detail.h>
+#include "proto_radius.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#ifdef HAVE_GLOB_H
+#  include <glob.h>
+#endif
+
+#define DETAIL_CHECKPOINT_MAGIC		(0x64746c63)
+#define DETAIL_CHECKPOINT_VERSION	(1)
+
+typedef struct proto_radius_detail_t proto_radius_detail_t;
+
+/** A record which has been handed to a worker
+ *
+ */
+typedef struct {
+	proto_radius_detail_t		*inst;			//!< The reader this record came from.
+
+	fr_dlist_t			entry;			//!< In the "sent" or "failed" list.
+
+	uint64_t			offset;			//!< Of the record in the work file.
+	size_t				len;			//!< Of the record.
+
+	fr_time_t			recv_time;		//!< When it was last given to a worker.
+	fr_time_t			when;			//!< When it was last sent, or failed.
+	uint32_t			tries;			//!< How many times it's been sent.
+
+	bool				acked;			//!< Finished with, and can be forgotten.
+} proto_radius_detail_record_t;
+
+/** Prepended to each record in the message
+ *
+ *  The worker can't look at the record structure, as the network
+ *  thread may be re-sending it.
+ */
+typedef struct {
+	uint32_t			tries;			//!< For Packet-Transmit-Counter.
+	uint32_t			counter;		//!< For the fake packet ID, and ports.
+} proto_radius_detail_header_t;
+
+/** What's written to the checkpoint file
+ *
+ */
+typedef struct {
+	uint32_t			magic;
+	uint32_t			version;
+	uint64_t			inode;			//!< Of the work file.
+	uint64_t			offset;			//!< Every record before this has been acknowledged.
+} proto_radius_detail_checkpoint_t;
+
+struct proto_radius_detail_t {
+	proto_radius_t	const		*parent;		//!< The module that spawned us!
+
+	char const			*filename;		//!< Detail file, or a glob.
+	char const			*filename_work;		//!< The file we're reading.
+	char const			*filename_checkpoint;	//!< Where we record our progress.
+
+	uint32_t			max_outstanding;	//!< Most records with the workers at once.
+	uint32_t			poll_interval;		//!< How often we look for new files.
+	uint32_t			retry_interval;		//!< How long we wait before re-sending a record.
+
+	char const			*format;		//!< "text" or "binary".
+	bool				binary;			//!< Records are written by rlm_detail
+								///< with "format = binary".
+
+	RADCLIENT			*client;		//!< Fake client for the requests.
+
+	fr_event_list_t			*el;			//!< For the poll timer.
+	fr_event_timer_t const		*ev;			//!< The poll timer.
+
+	int				pipe[2];		//!< The network thread waits on pipe[0].
+	bool				signalled;		//!< There's a byte in the pipe.
+
+	int				work_fd;		//!< The work file, or -1.
+	uint64_t			inode;			//!< Of the work file.
+	uint8_t				*map;			//!< The work file, mapped into memory.
+	size_t				map_size;		//!< Size of the work file.
+	bool				eof;			//!< There are no more records to read.
+
+	uint64_t			read_offset;		//!< Where the next record starts.
+	uint64_t			acked_offset;		//!< Every record before this has been acknowledged.
+	bool				checkpoint_dirty;	//!< acked_offset has moved since it was written.
+	int				checkpoint_fd;		//!< The checkpoint file, or -1.
+
+	proto_radius_detail_record_t	*record;		//!< Ring of records, in file order.
+	uint32_t			head;			//!< The oldest record in the ring.
+	uint32_t			num;			//!< Number of records in the ring.
+
+	fr_dlist_t			sent;			//!< Records with the workers, oldest first.
+	fr_dlist_t			failed;			//!< Records which had no reply, oldest first.
+
+	uint32_t			counter;		//!< For the fake packet ID, and ports.
+};
+
+static const CONF_PARSER detail_listen_config[] = {
+	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_REQUIRED, proto_radius_detail_t, filename) },
+
+	{ FR_CONF_OFFSET("max_outstanding", FR_TYPE_UINT32, proto_radius_detail_t, max_outstanding), .dflt = "1024" },
+	{ FR_CONF_OFFSET("poll_interval", FR_TYPE_UINT32, proto_radius_detail_t, poll_interval), .dflt = "1" },
+	{ FR_CONF_OFFSET("retry_interval", FR_TYPE_UINT32, proto_radius_detail_t, retry_interval), .dflt = "30" },
+
+	{ FR_CONF_OFFSET("format", FR_TYPE_STRING, proto_radius_detail_t, format), .dflt = "text" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+/** Return the src address associated with the packet_ctx
+ *
+ */
+static int mod_src_address(fr_socket_addr_t *src, UNUSED void const *instance, UNUSED void const *packet_ctx)
+{
+	memset(src, 0, sizeof(*src));
+
+	src->proto = IPPROTO_UDP;
+	src->ipaddr.af = AF_INET;
+	src->ipaddr.addr.v4.s_addr = htonl(INADDR_NONE);
+
+	return 0;
+}
+
+/** Return the dst address associated with the packet_ctx
+ *
+ */
+static int mod_dst_address(fr_socket_addr_t *dst, UNUSED void const *instance, UNUSED void const *packet_ctx)
+{
+	memset(dst, 0, sizeof(*dst));
+
+	dst->proto = IPPROTO_UDP;
+	dst->ipaddr.af = AF_INET;
+	dst->ipaddr.addr.v4.s_addr = htonl(INADDR_LOOPBACK);
+
+	return 0;
+}
+
+/** Return the client associated with the packet_ctx
+ *
+ */
+static RADCLIENT *mod_client(UNUSED void const *instance, void const *packet_ctx)
+{
+	proto_radius_detail_record_t const *record = packet_ctx;
+
+	return record->inst->client;
+}
+
+/** Tell the network thread that there's work to do
+ *
+ */
+static void mod_signal(proto_radius_detail_t *inst)
+{
+	char c = 0;
+
+	if (inst->signalled || (inst->pipe[1] < 0)) return;
+
+	if (write(inst->pipe[1], &c, 1) < 0) {
+		ERROR("detail (%s): Failed signalling reader: %s", inst->filename, fr_syserror(errno));
+		return;
+	}
+
+	inst->signalled = true;
+}
+
+/** Empty the pipe, so that we're not called again until there's work
+ *
+ */
+static void mod_drain(proto_radius_detail_t *inst)
+{
+	char buffer[64];
+
+	if (!inst->signalled) return;
+
+	while (read(inst->pipe[0], buffer, sizeof(buffer)) > 0) {
+		/* nothing */
+	}
+
+	inst->signalled = false;
+}
+
+/** Write the offset before which everything has been acknowledged
+ *
+ */
+static void mod_checkpoint_write(proto_radius_detail_t *inst)
+{
+	proto_radius_detail_checkpoint_t cp;
+
+	if (!inst->checkpoint_dirty || (inst->checkpoint_fd < 0)) return;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.magic = DETAIL_CHECKPOINT_MAGIC;
+	cp.version = DETAIL_CHECKPOINT_VERSION;
+	cp.inode = inst->inode;
+	cp.offset = inst->acked_offset;
+
+	if (pwrite(inst->checkpoint_fd, &cp, sizeof(cp), 0) != sizeof(cp)) {
+		WARN("detail (%s): Failed writing checkpoint %s: %s",
+		     inst->filename, inst->filename_checkpoint, fr_syserror(errno));
+		return;
+	}
+
+	inst->checkpoint_dirty = false;
+}
+
+/** Open the checkpoint file, and see where we got to last time
+ *
+ * @return where to start reading the work file.
+ */
+static uint64_t mod_checkpoint_open(proto_radius_detail_t *inst)
+{
+	proto_radius_detail_checkpoint_t cp;
+
+	inst->checkpoint_fd = open(inst->filename_checkpoint, O_RDWR | O_CREAT, 0640);
+	if (inst->checkpoint_fd < 0) {
+		WARN("detail (%s): Failed opening checkpoint %s: %s.  Acknowledged records will be "
+		     "re-read after a restart", inst->filename, inst->filename_checkpoint, fr_syserror(errno));
+		return 0;
+	}
+
+	if (pread(inst->checkpoint_fd, &cp, sizeof(cp), 0) != sizeof(cp)) return 0;
+
+	/*
+	 *	The checkpoint is for a different work file.
+	 */
+	if ((cp.magic != DETAIL_CHECKPOINT_MAGIC) || (cp.version != DETAIL_CHECKPOINT_VERSION) ||
+	    (cp.inode != inst->inode) || (cp.offset > inst->map_size)) return 0;
+
+	if (cp.offset > 0) {
+		DEBUG("detail (%s): Skipping %"PRIu64" bytes which have already been processed",
+		      inst->filename, cp.offset);
+	}
+
+	return cp.offset;
+}
+
+/** Close the work file
+ *
+ * @param[in] inst	of the detail reader.
+ * @param[in] done	all of the records have been acknowledged, so
+ *			remove the work and checkpoint files.
+ */
+static void mod_work_close(proto_radius_detail_t *inst, bool done)
+{
+	if (inst->work_fd < 0) return;
+
+	if (done) {
+		DEBUG("detail (%s): Unlinking %s", inst->filename, inst->filename_work);
+		unlink(inst->filename_work);
+		unlink(inst->filename_checkpoint);
+	} else {
+		mod_checkpoint_write(inst);
+	}
+
+	if (inst->map) munmap(inst->map, inst->map_size);
+	inst->map = NULL;
+	inst->map_size = 0;
+
+	if (inst->checkpoint_fd >= 0) close(inst->checkpoint_fd);
+	inst->checkpoint_fd = -1;
+
+	close(inst->work_fd);
+	inst->work_fd = -1;
+
+	FR_DLIST_INIT(inst->sent);
+	FR_DLIST_INIT(inst->failed);
+	inst->head = inst->num = 0;
+	inst->eof = false;
+	inst->checkpoint_dirty = false;
+}
+
+/** Open the work file, or rename the oldest detail file to it
+ *
+ *  The file is locked, and mapped into memory.
+ *
+ * @return
+ *	- 1 if the work file is open.
+ *	- 0 if there's nothing to read.
+ */
+static int mod_work_open(proto_radius_detail_t *inst)
+{
+	struct stat	st;
+
+	/*
+	 *	Open the work file first, so we don't lose accounting
+	 *	packets.  It's better to duplicate them than to lose
+	 *	them.
+	 *
+	 *	We only read the file, but it has to be opened for
+	 *	writing so that we can lock it.  The lock stops
+	 *	rlm_detail from writing to it.
+	 */
+	inst->work_fd = open(inst->filename_work, O_RDWR);
+	if ((inst->work_fd < 0) && (errno != ENOENT)) {
+		ERROR("detail (%s): Failed opening %s: %s",
+		      inst->filename, inst->filename_work, fr_syserror(errno));
+		return 0;
+	}
+
+	if (inst->work_fd < 0) {
+#ifndef HAVE_GLOB_H
+		return 0;
+#else
+		size_t		i;
+		int		found;
+		time_t		chtime;
+		glob_t		files;
+
+		DEBUG3("detail (%s): Polling for detail file", inst->filename);
+
+		memset(&files, 0, sizeof(files));
+		if (glob(inst->filename, 0, NULL, &files) != 0) {
+		noop:
+			globfree(&files);
+			return 0;
+		}
+
+		/*
+		 *	Loop over the glob'd files, looking for the
+		 *	oldest one.
+		 */
+		chtime = 0;
+		found = -1;
+		for (i = 0; i < files.gl_pathc; i++) {
+			if (stat(files.gl_pathv[i], &st) < 0) continue;
+
+			if ((found < 0) || (st.st_ctime < chtime)) {
+				chtime = st.st_ctime;
+				found = i;
+			}
+		}
+
+		if (found < 0) goto noop;
+
+		DEBUG("detail (%s): Renaming %s -> %s", inst->filename, files.gl_pathv[found], inst->filename_work);
+		if (rename(files.gl_pathv[found], inst->filename_work) < 0) {
+			ERROR("detail (%s): Failed renaming %s to %s: %s",
+			      inst->filename, files.gl_pathv[found], inst->filename_work, fr_syserror(errno));
+			goto noop;
+		}
+
+		globfree(&files);
+
+		inst->work_fd = open(inst->filename_work, O_RDWR);
+		if (inst->work_fd < 0) {
+			ERROR("detail (%s): Failed opening %s: %s",
+			      inst->filename, inst->filename_work, fr_syserror(errno));
+			return 0;
+		}
+#endif
+	}
+
+	/*
+	 *	We don't block waiting for the lock.  The file has
+	 *	been renamed, so no new writer will open it.  The lock
+	 *	catches a writer which opened it before the rename.
+	 *	Once we have it, the file doesn't change.
+	 */
+	if (rad_lockfd_nonblock(inst->work_fd, 0) < 0) {
+		close(inst->work_fd);
+		inst->work_fd = -1;
+		return 0;
+	}
+
+	if (fstat(inst->work_fd, &st) < 0) {
+		ERROR("detail (%s): Failed to stat %s: %s",
+		      inst->filename, inst->filename_work, fr_syserror(errno));
+		close(inst->work_fd);
+		inst->work_fd = -1;
+		return 0;
+	}
+
+	inst->inode = st.st_ino;
+	inst->map_size = st.st_size;
+	inst->map = NULL;
+
+	if (inst->map_size > 0) {
+		void *map;
+
+		map = mmap(NULL, inst->map_size, PROT_READ, MAP_SHARED, inst->work_fd, 0);
+		if (map == MAP_FAILED) {
+			ERROR("detail (%s): Failed mapping %s: %s",
+			      inst->filename, inst->filename_work, fr_syserror(errno));
+			close(inst->work_fd);
+			inst->work_fd = -1;
+			return 0;
+		}
+		inst->map = map;
+
+#ifdef MADV_SEQUENTIAL
+		(void) madvise(inst->map, inst->map_size, MADV_SEQUENTIAL);
+#endif
+	}
+
+	inst->read_offset = inst->acked_offset = mod_checkpoint_open(inst);
+	inst->checkpoint_dirty = false;
+	inst->eof = false;
+	inst->head = inst->num = 0;
+	FR_DLIST_INIT(inst->sent);
+	FR_DLIST_INIT(inst->failed);
+
+	return 1;
+}
+
+/** Find the next record in the work file
+ *
+ *  Records are separated by a blank line.
+ *
+ * @param[in] inst	of the detail reader.
+ * @param[out] offset	where the record starts.
+ * @return
+ *	- 0 if there are no more records.
+ *	- the length of the record, including its last newline.
+ */
+static size_t mod_record_find(proto_radius_detail_t *inst, uint64_t *offset)
+{
+	uint8_t const	*start, *p, *end;
+	size_t		len;
+
+	if (inst->binary) {
+		ssize_t slen;
+
+	again:
+		if (inst->read_offset >= inst->map_size) {
+			inst->eof = true;
+			return 0;
+		}
+
+		start = inst->map + inst->read_offset;
+		len = inst->map_size - inst->read_offset;
+
+		slen = fr_detail_binary_check(start, len);
+		if (slen > 0) {
+			*offset = inst->read_offset;
+			inst->read_offset += slen;
+			return slen;
+		}
+
+		if (slen == 0) goto truncated;
+
+		/*
+		 *	Skip to the next record, by looking for its
+		 *	magic number.
+		 */
+		ERROR("detail (%s): Skipping damaged record at offset %"PRIu64" in %s: %s",
+		      inst->filename, inst->read_offset, inst->filename_work, fr_strerror());
+		inst->read_offset += 1 + fr_detail_binary_resync(start + 1, len - 1);
+		goto again;
+	}
+
+	while ((inst->read_offset < inst->map_size) && (inst->map[inst->read_offset] == '\n')) {
+		inst->read_offset++;
+	}
+
+	if (inst->read_offset >= inst->map_size) {
+		inst->eof = true;
+		return 0;
+	}
+
+	start = inst->map + inst->read_offset;
+	end = inst->map + inst->map_size;
+
+	for (p = start; p < end; p++) {
+		p = memchr(p, '\n', end - p);
+		if (!p || ((p + 1) == end)) break;
+
+		if (p[1] == '\n') {
+			len = (p + 1) - start;
+			*offset = inst->read_offset;
+			inst->read_offset += len + 1;
+			return len;
+		}
+	}
+
+	/*
+	 *	The last record isn't followed by a blank line.
+	 */
+	if (end[-1] == '\n') {
+		len = end - start;
+		*offset = inst->read_offset;
+		inst->read_offset = inst->map_size;
+		return len;
+	}
+
+	/*
+	 *	The writer doesn't check that the record was
+	 *	completely written.  If the disk is full, this can
+	 *	result in a truncated record.  When that happens,
+	 *	treat it as EOF.
+	 */
+truncated:
+	ERROR("detail (%s): Truncated record: treating it as EOF for detail file %s",
+	      inst->filename, inst->filename_work);
+	inst->read_offset = inst->map_size;
+	inst->eof = true;
+
+	return 0;
+}
+
+/** See if a record has been marked as done by the old detail reader
+ *
+ */
+static bool mod_record_done(uint8_t const *data, size_t len)
+{
+	uint8_t const *p, *end;
+
+	end = data + len;
+
+	for (p = data; (p + 9) <= end; p++) {
+		p = memchr(p, 'D', (end - p) - 8);
+		if (!p) break;
+
+		if (memcmp(p, "Donestamp", 9) == 0) return true;
+	}
+
+	return false;
+}
+
+/** Forget the records at the start of the ring which have been acknowledged
+ *
+ */
+static void mod_record_advance(proto_radius_detail_t *inst)
+{
+	while (inst->num > 0) {
+		proto_radius_detail_record_t *record = &inst->record[inst->head];
+
+		if (!record->acked) break;
+
+		inst->acked_offset = record->offset + record->len;
+		inst->checkpoint_dirty = true;
+
+		inst->head++;
+		if (inst->head == inst->max_outstanding) inst->head = 0;
+		inst->num--;
+	}
+}
+
+/** Check if a record in the "sent" or "failed" list should be re-sent
+ *
+ */
+static proto_radius_detail_record_t *mod_record_retry(proto_radius_detail_t *inst, fr_dlist_t *head, fr_time_t now)
+{
+	fr_dlist_t			*entry;
+	proto_radius_detail_record_t	*record;
+
+	entry = FR_DLIST_FIRST((*head));
+	if (!entry) return NULL;
+
+	record = fr_ptr_to_type(proto_radius_detail_record_t, entry, entry);
+	if (now < (record->when + inst->retry_interval * (fr_time_t) NANOSEC)) return NULL;
+
+	return record;
+}
+
+/** Give the next record to a worker
+ *
+ *  Records which have had no reply for "retry_interval" are re-sent
+ *  first.  Otherwise, we read a new record, as long as there are
+ *  fewer than "max_outstanding" with the workers.
+ */
+static ssize_t mod_read(void const *instance, void **packet_ctx, fr_time_t **recv_time, uint8_t *buffer, size_t buffer_len)
+{
+	proto_radius_detail_t		*inst;
+	proto_radius_detail_record_t	*record;
+	proto_radius_detail_header_t	hdr;
+	fr_time_t			now;
+	uint64_t			offset;
+	size_t				len;
+
+	memcpy(&inst, &instance, sizeof(inst)); /* const issues */
+
+	inst = talloc_get_type_abort(inst, proto_radius_detail_t);
+
+	if ((inst->work_fd < 0) && !mod_work_open(inst)) goto idle;
+
+	now = fr_time();
+
+	record = mod_record_retry(inst, &inst->failed, now);
+	if (record) {
+		DEBUG("detail (%s): Retrying record at offset %"PRIu64, inst->filename, record->offset);
+		goto send;
+	}
+
+	record = mod_record_retry(inst, &inst->sent, now);
+	if (record) {
+		DEBUG("detail (%s): No response to record at offset %"PRIu64".  Retrying",
+		      inst->filename, record->offset);
+		goto send;
+	}
+
+	while (inst->num < inst->max_outstanding) {
+		len = mod_record_find(inst, &offset);
+		if (!len) break;
+
+		record = &inst->record[(inst->head + inst->num) % inst->max_outstanding];
+		inst->num++;
+
+		memset(record, 0, sizeof(*record));
+		record->inst = inst;
+		record->offset = offset;
+		record->len = len;
+		record->entry.prev = record->entry.next = &record->entry;
+
+		/*
+		 *	Records which have already been processed by
+		 *	the old detail reader are marked as done.
+		 */
+		if (!inst->binary && mod_record_done(inst->map + offset, len)) {
+			DEBUG2("detail (%s): Skipping record at offset %"PRIu64" which has already been processed",
+			       inst->filename, offset);
+			goto skip;
+		}
+
+		if (!inst->binary && !memchr(inst->map + offset, '=', len)) {
+			WARN("detail (%s): Skipping empty record at offset %"PRIu64, inst->filename, offset);
+			goto skip;
+		}
+
+		if ((len + sizeof(hdr)) > buffer_len) {
+			ERROR("detail (%s): Skipping record at offset %"PRIu64" which is too large (%zu bytes)",
+			      inst->filename, offset, len);
+			goto skip;
+		}
+
+		goto send;
+
+	skip:
+		record->acked = true;
+		mod_record_advance(inst);
+	}
+
+	/*
+	 *	Everything has been acknowledged.  Remove the file, and
+	 *	look for the next one.
+	 */
+	if (inst->eof && !inst->num) {
+		mod_work_close(inst, true);
+		mod_drain(inst);
+		mod_signal(inst);
+		return 0;
+	}
+
+idle:
+	mod_drain(inst);
+	return 0;
+
+send:
+	fr_dlist_remove(&record->entry);
+
+	record->tries++;
+	record->recv_time = now;
+	record->when = now;
+	fr_dlist_insert_tail(&inst->sent, &record->entry);
+
+	hdr.tries = record->tries;
+	hdr.counter = inst->counter++;
+
+	memcpy(buffer, &hdr, sizeof(hdr));
+	memcpy(buffer + sizeof(hdr), inst->map + record->offset, record->len);
+
+	*packet_ctx = record;
+	*recv_time = &record->recv_time;
+
+	return sizeof(hdr) + record->len;
+}
+
+/** Record the result of processing a record
+ *
+ *  A reply means the record has been processed.  No reply means it
+ *  failed, and it's re-sent after "retry_interval".
+ */
+static ssize_t mod_write(void const *instance, void *packet_ctx,
+			 fr_time_t request_time, UNUSED uint8_t *buffer, size_t buffer_len)
+{
+	proto_radius_detail_t		*inst;
+	proto_radius_detail_record_t	*record = packet_ctx;
+
+	memcpy(&inst, &instance, sizeof(inst)); /* const issues */
+
+	inst = talloc_get_type_abort(inst, proto_radius_detail_t);
+
+	/*
+	 *	The record has been re-sent since, or the file has
+	 *	been closed.
+	 */
+	if ((inst->work_fd < 0) || record->acked || (record->recv_time != request_time)) return buffer_len;
+
+	fr_dlist_remove(&record->entry);
+
+	if (!buffer_len) {
+		DEBUG("detail (%s): No reply to record at offset %"PRIu64".  Retrying in %u seconds",
+		      inst->filename, record->offset, inst->retry_interval);
+		record->when = fr_time();
+		fr_dlist_insert_tail(&inst->failed, &record->entry);
+		return 0;
+	}
+
+	record->acked = true;
+	mod_record_advance(inst);
+
+	/*
+	 *	There's room for another record, or the file may be
+	 *	finished.
+	 */
+	mod_signal(inst);
+
+	return buffer_len;
+}
+
+/** Don't reply to records we couldn't decode
+ *
+ *  The record is re-sent after "retry_interval".
+ */
+static size_t mod_nak(UNUSED void const *instance, UNUSED uint8_t *const packet, UNUSED size_t packet_len,
+		      UNUSED uint8_t *reply, UNUSED size_t reply_len)
+{
+	return 0;
+}
+
+/** Parse a text record
+ *
+ */
+static void mod_decode_text(REQUEST *request, char const *p, char const *end,
+			    time_t *timestamp, fr_ipaddr_t *client_ip, unsigned int *code)
+{
+	RADIUS_PACKET			*packet = request->packet;
+	char const			*q;
+	char				buffer[2048];
+	char				key[256], op[8], value[1024];
+	bool				header = false;
+	vp_cursor_t			cursor;
+	VALUE_PAIR			*vp;
+
+	fr_pair_cursor_init(&cursor, &packet->vps);
+
+	for (; p < end; p = q + 1) {
+		size_t len;
+
+		q = memchr(p, '\n', end - p);
+		if (!q) q = end;
+
+		len = q - p;
+		if (len >= sizeof(buffer)) {
+			RWDEBUG("Skipping line which is too long");
+			continue;
+		}
+		memcpy(buffer, p, len);
+		buffer[len] = '\0';
+
+		/*
+		 *	Look for the date/time header, and read VPs
+		 *	after it.
+		 */
+		if (!header) {
+			int y;
+
+			if (sscanf(buffer, "%*s %*s %*d %*d:%*d:%*d %d", &y) == 1) header = true;
+			continue;
+		}
+
+		/*
+		 *	We have a full "attribute = value" line.
+		 *	If it doesn't look reasonable, skip it.
+		 */
+		if (sscanf(buffer, "%255s %7s %1023s", key, op, value) != 3) {
+			RWDEBUG("Skipping badly formatted line %s", buffer);
+			continue;
+		}
+
+		/*
+		 *	Should be =, :=, +=, ...
+		 */
+		if (!strchr(op, '=')) {
+			RWDEBUG("Skipping line without operator - %s", buffer);
+			continue;
+		}
+
+		/*
+		 *	Skip non-protocol attributes.
+		 */
+		if (!strcasecmp(key, "Request-Authenticator")) continue;
+
+		/*
+		 *	Set the original client IP address, based on
+		 *	what's in the detail file.
+		 */
+		if (!strcasecmp(key, "Client-IP-Address")) {
+			client_ip->af = AF_INET;
+			if (fr_inet_hton(client_ip, AF_INET, value, false) < 0) {
+				RWDEBUG("Failed parsing Client-IP-Address");
+				client_ip->af = AF_UNSPEC;
+			}
+			continue;
+		}
+
+		/*
+		 *	The original time at which we received the
+		 *	packet.  We need this to properly calculate
+		 *	Acct-Delay-Time.
+		 */
+		if (!strcasecmp(key, "Timestamp")) {
+			*timestamp = atoi(value);
+
+			vp = fr_pair_afrom_num(packet, 0, FR_PACKET_ORIGINAL_TIMESTAMP);
+			if (vp) {
+				vp->vp_date = (uint32_t) *timestamp;
+				vp->type = VT_DATA;
+				fr_pair_cursor_append(&cursor, vp);
+			}
+			continue;
+		}
+
+		RDEBUG3("Trying to read VP from line - %s", buffer);
+
+		vp = NULL;
+		if ((fr_pair_list_afrom_str(packet, buffer, &vp) > 0) && (vp != NULL)) {
+			fr_pair_cursor_merge(&cursor, vp);
+		} else {
+			RWDEBUG("Failed reading VP from line - %s", buffer);
+		}
+	}
+
+	vp = fr_pair_find_by_num(packet->vps, 0, FR_PACKET_TYPE, TAG_ANY);
+	if (vp) *code = vp->vp_uint32;
+}
+
+/** Read a binary record
+ *
+ */
+static int mod_decode_binary(REQUEST *request, uint8_t const *data, size_t data_len,
+			     time_t *timestamp, fr_ipaddr_t *client_ip, fr_ipaddr_t *server_ip, unsigned int *code)
+{
+	RADIUS_PACKET			*packet = request->packet;
+	fr_detail_record_t		rec;
+	VALUE_PAIR			*vp;
+	int				skipped;
+
+	skipped = fr_detail_binary_decode(packet, &rec, &packet->vps, data, data_len);
+	if (skipped < 0) {
+		RPEDEBUG("Failed reading detail record");
+		return -1;
+	}
+	if (skipped > 0) RWDEBUG("Skipped %i attributes which don't match the dictionary", skipped);
+
+	*timestamp = rec.timestamp.tv_sec;
+	*client_ip = rec.src_ipaddr;
+	*server_ip = rec.dst_ipaddr;
+	*code = rec.code;
+
+	vp = fr_pair_afrom_num(packet, 0, FR_PACKET_ORIGINAL_TIMESTAMP);
+	if (vp) {
+		vp->vp_date = (uint32_t) *timestamp;
+		vp->type = VT_DATA;
+		fr_pair_add(&packet->vps, vp);
+	}
+
+	return 0;
+}
+
+/** Turn a record into a request
+ *
+ *  This runs in the worker threads, so it can't touch any of the
+ *  reader's state.
+ */
+static int mod_decode(void const *instance, REQUEST *request, uint8_t *const data, size_t data_len)
+{
+	proto_radius_detail_t const	*inst = talloc_get_type_abort(instance, proto_radius_detail_t);
+	RADIUS_PACKET			*packet = request->packet;
+	proto_radius_detail_header_t	hdr;
+	time_t				timestamp = 0;
+	fr_ipaddr_t			client_ip, server_ip;
+	unsigned int			code = FR_CODE_ACCOUNTING_REQUEST;
+	VALUE_PAIR			*vp;
+
+	if (data_len < sizeof(hdr)) return -1;
+
+	memcpy(&hdr, data, sizeof(hdr));
+
+	memset(&client_ip, 0, sizeof(client_ip));
+	client_ip.af = AF_UNSPEC;
+	server_ip = client_ip;
+
+	if (inst->binary) {
+		if (mod_decode_binary(request, data + sizeof(hdr), data_len - sizeof(hdr),
+				      &timestamp, &client_ip, &server_ip, &code) < 0) return -1;
+	} else {
+		mod_decode_text(request, (char const *) data + sizeof(hdr), (char const *) data + data_len,
+				&timestamp, &client_ip, &code);
+	}
+
+	if (!packet->vps) {
+		REDEBUG("Detail record has no attributes");
+		return -1;
+	}
+
+	if (!code || (code >= FR_CODE_MAX) || !inst->parent->code_allowed[code]) {
+		REDEBUG("Packet code %u is not accepted by this listener", code);
+		return -1;
+	}
+	packet->code = code;
+
+	/*
+	 *	Remember where it came from, so that we don't proxy
+	 *	it to the place it came from...
+	 */
+	packet->src_ipaddr.af = AF_INET;
+	packet->src_ipaddr.addr.v4.s_addr = htonl(INADDR_NONE);
+	if (client_ip.af != AF_UNSPEC) packet->src_ipaddr = client_ip;
+
+	vp = fr_pair_find_by_num(packet->vps, 0, FR_PACKET_SRC_IP_ADDRESS, TAG_ANY);
+	if (vp) {
+		packet->src_ipaddr.af = AF_INET;
+		packet->src_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
+		packet->src_ipaddr.prefix = 32;
+	} else {
+		vp = fr_pair_find_by_num(packet->vps, 0, FR_PACKET_SRC_IPV6_ADDRESS, TAG_ANY);
+		if (vp) {
+			packet->src_ipaddr.af = AF_INET6;
+			memcpy(&packet->src_ipaddr.addr.v6,
+			       &vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
+			packet->src_ipaddr.prefix = 128;
+		}
+	}
+
+	/*
+	 *	Generate packet ID, ports, IP via a counter.
+	 */
+	packet->id = hdr.counter & 0xff;
+	packet->src_port = 1024 + ((hdr.counter >> 8) & 0xff);
+	packet->dst_port = 1024 + ((hdr.counter >> 16) & 0xff);
+
+	packet->dst_ipaddr.af = AF_INET;
+	packet->dst_ipaddr.addr.v4.s_addr = htonl((INADDR_LOOPBACK & ~0xffffff) | ((hdr.counter >> 24) & 0xff));
+	if (server_ip.af != AF_UNSPEC) packet->dst_ipaddr = server_ip;
+
+	vp = fr_pair_find_by_num(packet->vps, 0, FR_PACKET_DST_IP_ADDRESS, TAG_ANY);
+	if (vp) {
+		packet->dst_ipaddr.af = AF_INET;
+		packet->dst_ipaddr.addr.v4.s_addr = vp->vp_ipv4addr;
+		packet->dst_ipaddr.prefix = 32;
+	} else {
+		vp = fr_pair_find_by_num(packet->vps, 0, FR_PACKET_DST_IPV6_ADDRESS, TAG_ANY);
+		if (vp) {
+			packet->dst_ipaddr.af = AF_INET6;
+			memcpy(&packet->dst_ipaddr.addr.v6,
+			       &vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
+			packet->dst_ipaddr.prefix = 128;
+		}
+	}
+
+	/*
+	 *	Create / update accounting attributes.
+	 */
+	if (packet->code == FR_CODE_ACCOUNTING_REQUEST) {
+		/*
+		 *	Prefer the Event-Timestamp in the packet, if it
+		 *	exists.  That is when the event occurred, whereas
+		 *	the "Timestamp" field is when we wrote the packet
+		 *	to the detail file, which could have been much
+		 *	later.
+		 */
+		vp = fr_pair_find_by_num(packet->vps, 0, FR_EVENT_TIMESTAMP, TAG_ANY);
+		if (vp) timestamp = vp->vp_uint32;
+
+		/*
+		 *	Look for Acct-Delay-Time, and update
+		 *	based on Acct-Delay-Time += (time(NULL) - timestamp)
+		 */
+		vp = fr_pair_find_by_num(packet->vps, 0, FR_ACCT_DELAY_TIME, TAG_ANY);
+		if (!vp) {
+			vp = fr_pair_afrom_num(packet, 0, FR_ACCT_DELAY_TIME);
+			if (!vp) return -1;
+			fr_pair_add(&packet->vps, vp);
+		}
+		if (timestamp != 0) vp->vp_uint32 += time(NULL) - timestamp;
+	}
+
+	/*
+	 *	Set the transmission count.
+	 */
+	vp = fr_pair_find_by_num(packet->vps, 0, FR_PACKET_TRANSMIT_COUNTER, TAG_ANY);
+	if (!vp) {
+		vp = fr_pair_afrom_num(packet, 0, FR_PACKET_TRANSMIT_COUNTER);
+		if (!vp) return -1;
+		fr_pair_add(&packet->vps, vp);
+	}
+	vp->vp_uint32 = hdr.tries;
+
+	request->client = inst->client;
+
+	request->reply->id = packet->id;
+	request->reply->src_ipaddr = packet->dst_ipaddr;
+	request->reply->src_port = packet->dst_port;
+	request->reply->dst_ipaddr = packet->src_ipaddr;
+	request->reply->dst_port = packet->src_port;
+
+	request->root = &main_config;
+	VERIFY_REQUEST(request);
+
+	return 0;
+}
+
+/** Look for new files, re-send records, and save our progress
+ *
+ */
+static void mod_timer(fr_event_list_t *el, struct timeval *now, void *uctx)
+{
+	proto_radius_detail_t	*inst = talloc_get_type_abort(uctx, proto_radius_detail_t);
+	struct timeval		when;
+
+	mod_checkpoint_write(inst);
+	mod_signal(inst);
+
+	when = *now;
+	when.tv_sec += inst->poll_interval;
+
+	if (fr_event_timer_insert(inst, el, &inst->ev, &when, mod_timer, inst) < 0) {
+		ERROR("detail (%s): Failed inserting poll timer: %s", inst->filename, fr_strerror());
+	}
+}
+
+/** Open the pipe which the network thread waits on
+ *
+ * @param[in] instance of the RADIUS detail I/O path.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int mod_open(void *instance)
+{
+	proto_radius_detail_t *inst = talloc_get_type_abort(instance, proto_radius_detail_t);
+
+	if (pipe(inst->pipe) < 0) {
+		ERROR("detail (%s): Failed opening pipe: %s", inst->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if ((fr_nonblock(inst->pipe[0]) < 0) || (fr_nonblock(inst->pipe[1]) < 0)) {
+		ERROR("detail (%s): Failed setting pipe to non-blocking: %s", inst->filename, fr_strerror());
+		close(inst->pipe[0]);
+		close(inst->pipe[1]);
+		inst->pipe[0] = inst->pipe[1] = -1;
+		return -1;
+	}
+
+	inst->signalled = false;
+
+	return 0;
+}
+
+/** Get the file descriptor for this reader.
+ *
+ *  This is the read end of the pipe, which is readable whenever
+ *  there's work to do.
+ *
+ * @param[in] instance of the RADIUS detail I/O path.
+ * @return the file descriptor
+ */
+static int mod_fd(void const *instance)
+{
+	proto_radius_detail_t const *inst = talloc_get_type_abort(instance, proto_radius_detail_t);
+
+	return inst->pipe[0];
+}
+
+/** Close the pipe and the work file
+ *
+ *  The checkpoint is saved, so that we carry on from where we got
+ *  to.
+ *
+ * @param[in] instance of the RADIUS detail I/O path.
+ * @return
+ *	- 0 on success.
+ */
+static int mod_close(void const *instance)
+{
+	proto_radius_detail_t *inst;
+
+	memcpy(&inst, &instance, sizeof(inst)); /* const issues */
+
+	inst = talloc_get_type_abort(inst, proto_radius_detail_t);
+
+	if (inst->el) (void) fr_event_timer_delete(inst->el, &inst->ev);
+	inst->el = NULL;
+
+	mod_work_close(inst, false);
+
+	if (inst->pipe[0] >= 0) close(inst->pipe[0]);
+	if (inst->pipe[1] >= 0) close(inst->pipe[1]);
+	inst->pipe[0] = inst->pipe[1] = -1;
+
+	return 0;
+}
+
+/** Set the event list for the reader
+ *
+ *  We poll for new detail files, and re-send records which haven't
+ *  had a reply, from a timer.
+ *
+ * @param[in] instance of the RADIUS detail I/O path.
+ * @param[in] el the event list
+ */
+static void mod_event_list_set(void const *instance, fr_event_list_t *el)
+{
+	proto_radius_detail_t	*inst;
+	struct timeval		now;
+
+	memcpy(&inst, &instance, sizeof(inst)); /* const issues */
+
+	inst = talloc_get_type_abort(inst, proto_radius_detail_t);
+
+	inst->el = el;
+
+	gettimeofday(&now, NULL);
+	mod_timer(el, &now, inst);
+}
+
+static int mod_instantiate(void *instance, CONF_SECTION *cs)
+{
+	proto_radius_detail_t	*inst = talloc_get_type_abort(instance, proto_radius_detail_t);
+	RADCLIENT		*client;
+	char			buffer[2048];
+
+	FR_INTEGER_BOUND_CHECK("max_outstanding", inst->max_outstanding, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_outstanding", inst->max_outstanding, <=, 65536);
+
+	FR_INTEGER_BOUND_CHECK("poll_interval", inst->poll_interval, >=, 1);
+	FR_INTEGER_BOUND_CHECK("poll_interval", inst->poll_interval, <=, 60);
+
+	FR_INTEGER_BOUND_CHECK("retry_interval", inst->retry_interval, >=, 4);
+	FR_INTEGER_BOUND_CHECK("retry_interval", inst->retry_interval, <=, 3600);
+
+	if (strcmp(inst->format, "binary") == 0) {
+		inst->binary = true;
+	} else if (strcmp(inst->format, "text") != 0) {
+		cf_log_err(cs, "Invalid value '%s' for 'format'.  Must be 'text' or 'binary'", inst->format);
+		return -1;
+	}
+
+	/*
+	 *	If the filename is a glob, use "detail.work" as the
+	 *	work file name.
+	 */
+	if ((strchr(inst->filename, '*') != NULL) ||
+	    (strchr(inst->filename, '[') != NULL)) {
+		char *p;
+
+#ifndef HAVE_GLOB_H
+		cf_log_warn(cs, "File \"%s\" appears to use file globbing, but it is not supported on this system",
+			    inst->filename);
+#endif
+		strlcpy(buffer, inst->filename, sizeof(buffer));
+		p = strrchr(buffer, FR_DIR_SEP);
+		if (p) {
+			p[1] = '\0';
+		} else {
+			buffer[0] = '\0';
+		}
+
+		/*
+		 *	Globbing cannot be done across directories.
+		 */
+		if ((strchr(buffer, '*') != NULL) ||
+		    (strchr(buffer, '[') != NULL)) {
+			cf_log_err(cs, "Wildcard directories are not supported");
+			return -1;
+		}
+
+		strlcat(buffer, "detail.work", sizeof(buffer) - strlen(buffer));
+
+	} else {
+		snprintf(buffer, sizeof(buffer), "%s.work", inst->filename);
+	}
+
+	inst->filename_work = talloc_strdup(inst, buffer);
+	inst->filename_checkpoint = talloc_asprintf(inst, "%s.checkpoint", inst->filename_work);
+
+	inst->record = talloc_array(inst, proto_radius_detail_record_t, inst->max_outstanding);
+	if (!inst->record) {
+		cf_log_err(cs, "Failed allocating memory");
+		return -1;
+	}
+
+	inst->pipe[0] = inst->pipe[1] = -1;
+	inst->work_fd = -1;
+	inst->checkpoint_fd = -1;
+	FR_DLIST_INIT(inst->sent);
+	FR_DLIST_INIT(inst->failed);
+
+	/*
+	 *	Initialize the fake client.
+	 */
+	client = inst->client = talloc_zero(inst, RADCLIENT);
+	if (!client) {
+		cf_log_err(cs, "Failed allocating memory");
+		return -1;
+	}
+
+	client->ipaddr.af = AF_INET;
+	client->ipaddr.addr.v4.s_addr = INADDR_NONE;
+	client->ipaddr.prefix = 0;
+	client->longname = client->shortname = inst->filename;
+	client->secret = client->shortname;
+	client->nas_type = talloc_strdup(client, "none");
+	client->server_cs = inst->parent->server_cs;
+
+	return 0;
+}
+
+static int mod_bootstrap(void *instance, UNUSED CONF_SECTION *cs)
+{
+	proto_radius_detail_t	*inst = talloc_get_type_abort(instance, proto_radius_detail_t);
+	dl_instance_t const	*dl_inst;
+
+	/*
+	 *	Find the dl_instance_t holding our instance data
+	 *	so we can find out what the parent of our instance
+	 *	was.
+	 */
+	dl_inst = dl_instance_find(instance);
+	rad_assert(dl_inst);
+
+	inst->parent = talloc_get_type_abort(dl_inst->parent->data, proto_radius_t);
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	proto_radius_detail_t	*inst = talloc_get_type_abort(instance, proto_radius_detail_t);
+
+	mod_work_close(inst, false);
+
+	if (inst->pipe[0] >= 0) close(inst->pipe[0]);
+	if (inst->pipe[1] >= 0) close(inst->pipe[1]);
+
+	return 0;
+}
+
+
+/** Private interface for use by proto_radius
+ *
+ */
+extern proto_radius_app_io_t proto_radius_app_io_private;
+proto_radius_app_io_t proto_radius_app_io_private = {
+	.client			= mod_client,
+	.src			= mod_src_address,
+	.dst			= mod_dst_address,
+	.decode			= mod_decode
+};
+
+extern fr_app_io_t proto_radius_detail;
+fr_app_io_t proto_radius_detail = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "radius_detail",
+	.config			= detail_listen_config,
+	.inst_size		= sizeof(proto_radius_detail_t),
+	.detach			= mod_detach,
+	.bootstrap		= mod_bootstrap,
+	.instantiate		= mod_instantiate,
+
+	.default_message_size	= 16384,
+	.max_reads		= 64,
+	.open			= mod_open,
+	.close			= mod_close,
+	.read			= mod_read,
+	.write			= mod_write,
+	.nak			= mod_nak,
+	.fd			= mod_fd,
+	.event_list_set		= mod_event_list_set,
+};
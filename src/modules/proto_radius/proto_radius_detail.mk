@@ -0,0 +1,9 @@
+TARGETNAME	:= proto_radius_detail
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME).a
+endif
+
+SOURCES		:= proto_radius_detail.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-radius.a
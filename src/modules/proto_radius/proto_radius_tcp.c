@@ -0,0 +1,939 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_radius_tcp.c
+ * @brief RADIUS handler for TCP, and for RADIUS over TLS (RFC 6614).
+ *
+ * @copyright 2017 The FreeRADIUS server project.
+ */
+#include <netdb.h>
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/protocol.h>
+#include <freeradius-devel/radius/radius.h>
+#include <freeradius-devel/io/io.h>
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/track.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/rad_assert.h>
+#include "proto_radius.h"
+
+/*
+ *	Everything before "timestamp" is the key for the tracking table.
+ *
+ *	Each connection has its own tracking table, so the key is the
+ *	same for all packets on a connection, and the packets are told
+ *	apart by their ID.
+ */
+typedef struct {
+	int				if_index;
+
+	fr_ipaddr_t			src_ipaddr;
+	fr_ipaddr_t			dst_ipaddr;
+	uint16_t			src_port;
+	uint16_t 			dst_port;
+
+	fr_time_t			timestamp;
+
+	RADCLIENT			*client;
+} proto_radius_tcp_address_t;
+
+/*
+ *	The most data we queue for a connection which isn't reading
+ *	its replies, before giving up on it.
+ */
+#define TCP_MAX_QUEUED (64 * MAX_PACKET_LEN)
+
+typedef struct proto_radius_tcp_t proto_radius_tcp_t;
+
+/** A listening socket, or a connection accepted on one
+ *
+ *  Connections start as a copy of the listening socket's instance.
+ */
+struct proto_radius_tcp_t {
+	proto_radius_t	const		*parent;		//!< The module that spawned us!
+
+	int				sockfd;
+
+	fr_ipaddr_t			ipaddr;			//!< Ipaddr to listen on.
+
+	bool				ipaddr_is_set;		//!< ipaddr config item is set.
+	bool				ipv4addr_is_set;	//!< ipv4addr config item is set.
+	bool				ipv6addr_is_set;	//!< ipv6addr config item is set.
+
+	char const			*interface;		//!< Interface to bind to.
+	char const			*port_name;		//!< Name of the port for getservent().
+
+	uint16_t			port;			//!< Port to listen on.
+
+	uint32_t			max_connections;	//!< Maximum number of connections on the
+								//!< listening socket.  0 means no limit.
+	uint32_t			num_connections;	//!< Number of connections open.
+
+	proto_radius_tcp_t		*listener;		//!< The listening socket this connection was
+								//!< accepted on, or NULL if we're the listener.
+
+	proto_radius_tcp_address_t	address;		//!< Addresses of the connection.
+	fr_tracking_t			*ft;			//!< tracking table for the connection.
+
+	size_t				partial;		//!< How much of the current packet we've read.
+
+	uint8_t				*tx;			//!< Replies we haven't yet written.
+	size_t				tx_used;		//!< How much data is in "tx".
+
+#ifdef WITH_TLS
+	fr_tls_conf_t			*tls;			//!< TLS configuration, if this is RadSec.
+
+	REQUEST				*request;		//!< For logging, and OpenSSL callbacks.
+	tls_session_t			*tls_session;		//!< TLS state for the connection.
+	bool				tls_started;		//!< We've received the start of the handshake.
+#endif
+};
+
+static const CONF_PARSER tcp_listen_config[] = {
+	{ FR_CONF_IS_SET_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, proto_radius_tcp_t, ipaddr) },
+	{ FR_CONF_IS_SET_OFFSET("ipv4addr", FR_TYPE_IPV4_ADDR, proto_radius_tcp_t, ipaddr) },
+	{ FR_CONF_IS_SET_OFFSET("ipv6addr", FR_TYPE_IPV6_ADDR, proto_radius_tcp_t, ipaddr) },
+
+	{ FR_CONF_OFFSET("interface", FR_TYPE_STRING, proto_radius_tcp_t, interface) },
+	{ FR_CONF_OFFSET("port_name", FR_TYPE_STRING, proto_radius_tcp_t, port_name) },
+
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, proto_radius_tcp_t, port) },
+
+	{ FR_CONF_OFFSET("max_connections", FR_TYPE_UINT32, proto_radius_tcp_t, max_connections), .dflt = "64" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+/** Return the src address associated with the packet_ctx
+ *
+ */
+static int mod_src_address(fr_socket_addr_t *src, UNUSED void const *instance, void const *packet_ctx)
+{
+	fr_tracking_entry_t const		*track = packet_ctx;
+	proto_radius_tcp_address_t const	*address = track->src_dst;
+
+	rad_assert(track->src_dst_size == sizeof(proto_radius_tcp_address_t));
+
+	memset(src, 0, sizeof(*src));
+
+	src->proto = IPPROTO_TCP;
+	memcpy(&src->ipaddr, &address->src_ipaddr, sizeof(src->ipaddr));
+
+	return 0;
+}
+
+/** Return the dst address associated with the packet_ctx
+ *
+ */
+static int mod_dst_address(fr_socket_addr_t *dst, UNUSED void const *instance, void const *packet_ctx)
+{
+	fr_tracking_entry_t const		*track = packet_ctx;
+	proto_radius_tcp_address_t const	*address = track->src_dst;
+
+	rad_assert(track->src_dst_size == sizeof(proto_radius_tcp_address_t));
+
+	memset(dst, 0, sizeof(*dst));
+
+	dst->proto = IPPROTO_TCP;
+	memcpy(&dst->ipaddr, &address->dst_ipaddr, sizeof(dst->ipaddr));
+
+	return 0;
+}
+
+/** Return the client associated with the packet_ctx
+ *
+ */
+static RADCLIENT *mod_client(UNUSED void const *instance, void const *packet_ctx)
+{
+	fr_tracking_entry_t const		*track = packet_ctx;
+	proto_radius_tcp_address_t const	*address = track->src_dst;
+
+	rad_assert(track->src_dst_size == sizeof(proto_radius_tcp_address_t));
+
+	return address->client;
+}
+
+/*
+ *	proto_radius passes us its own instance, so everything has to
+ *	come from the packet_ctx.
+ */
+static int mod_decode(UNUSED void const *instance, REQUEST *request, UNUSED uint8_t *const data, UNUSED size_t data_len)
+{
+	fr_tracking_entry_t const		*track = request->async->packet_ctx;
+	proto_radius_tcp_address_t const	*address = track->src_dst;
+
+	rad_assert(track->src_dst_size == sizeof(proto_radius_tcp_address_t));
+
+	request->client = address->client;
+	request->packet->if_index = address->if_index;
+	request->packet->src_ipaddr = address->src_ipaddr;
+	request->packet->src_port = address->src_port;
+	request->packet->dst_ipaddr = address->dst_ipaddr;
+	request->packet->dst_port = address->dst_port;
+
+	request->reply->if_index = address->if_index;
+	request->reply->src_ipaddr = address->dst_ipaddr;
+	request->reply->src_port = address->dst_port;
+	request->reply->dst_ipaddr = address->src_ipaddr;
+	request->reply->dst_port = address->src_port;
+
+	request->root = &main_config;
+	VERIFY_REQUEST(request);
+
+	return 0;
+}
+
+/** Write any queued data
+ *
+ * @param[in] instance of the RADIUS TCP connection.
+ * @return
+ *	- 0 if everything was written.
+ *	- 1 if data is still queued, and we need to wait for the socket to become writable.
+ *	- <0 on error.
+ */
+static int mod_flush(void const *instance)
+{
+	proto_radius_tcp_t	*conn;
+	ssize_t			rcode;
+
+	memcpy(&conn, &instance, sizeof(conn)); /* const issues */
+
+	conn = talloc_get_type_abort(conn, proto_radius_tcp_t);
+
+	if (!conn->tx_used) return 0;
+
+	if (conn->sockfd < 0) {
+		conn->tx_used = 0;
+		return 0;
+	}
+
+	rcode = write(conn->sockfd, conn->tx, conn->tx_used);
+	if (rcode < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 1;
+
+		fr_strerror_printf("Failed writing to socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	conn->tx_used -= rcode;
+	if (conn->tx_used) {
+		memmove(conn->tx, conn->tx + rcode, conn->tx_used);
+		return 1;
+	}
+
+	return 0;
+}
+
+/** Add data to the end of the write queue
+ *
+ */
+static int mod_queue(proto_radius_tcp_t *conn, uint8_t const *data, size_t data_len)
+{
+	if ((conn->tx_used + data_len) > TCP_MAX_QUEUED) {
+		fr_strerror_printf("Too much data queued for client %pV:%u",
+				   fr_box_ipaddr(conn->address.src_ipaddr), conn->address.src_port);
+		return -1;
+	}
+
+	if ((conn->tx_used + data_len) > talloc_array_length(conn->tx)) {
+		uint8_t *tx;
+
+		tx = talloc_realloc(conn, conn->tx, uint8_t, conn->tx_used + data_len + MAX_PACKET_LEN);
+		if (!tx) {
+			fr_strerror_printf("Failed allocating memory");
+			return -1;
+		}
+		conn->tx = tx;
+	}
+
+	memcpy(conn->tx + conn->tx_used, data, data_len);
+	conn->tx_used += data_len;
+
+	return 0;
+}
+
+#ifdef WITH_TLS
+/** Read decrypted data from a TLS connection
+ *
+ *  Continues the handshake if it hasn't finished.  Decrypted data
+ *  which the caller didn't ask for is kept in clean_out, for the
+ *  next call.
+ *
+ * @return
+ *	- <0 on error, or if the connection was closed.
+ *	- 0 if there is no data.
+ *	- >0 the amount of data read.
+ */
+static ssize_t mod_recv_tls(proto_radius_tcp_t *conn, uint8_t *buffer, size_t buffer_len)
+{
+	tls_session_t	*tls_session = conn->tls_session;
+	REQUEST		*request = conn->request;
+	bool		pending = true;
+	ssize_t		rcode;
+
+	while (tls_session->clean_out.used == 0) {
+		/*
+		 *	A record we've already read may hold more
+		 *	than one packet.  Try those before reading
+		 *	the socket, but only once for each read, as
+		 *	there may only be part of a record.
+		 */
+		if (pending && SSL_is_init_finished(tls_session->ssl) &&
+		    (SSL_pending(tls_session->ssl) || BIO_ctrl_pending(tls_session->into_ssl))) {
+			pending = false;
+			if (tls_session_recv(request, tls_session) < 0) goto error;
+			continue;
+		}
+
+		if (tls_record_reserve(&tls_session->dirty_in, FR_TLS_MAX_RECORD_SIZE) < 0) return -1;
+
+		rcode = read(conn->sockfd, tls_session->dirty_in.data, tls_session->dirty_in.size);
+		if (rcode < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+			fr_strerror_printf("Failed reading from socket: %s", fr_syserror(errno));
+			return -1;
+		}
+
+		if (rcode == 0) {
+			fr_strerror_printf("Connection closed by client");
+			return -1;
+		}
+
+		tls_session->dirty_in.used = rcode;
+		pending = true;
+
+		/*
+		 *	Catch attempts to use non-SSL.
+		 */
+		if (!conn->tls_started && (tls_session->dirty_in.data[0] != 22)) {
+			fr_strerror_printf("Non-TLS data sent to TLS socket");
+			return -1;
+		}
+		conn->tls_started = true;
+
+		if (!SSL_is_init_finished(tls_session->ssl)) {
+			if (!tls_session_handshake(request, tls_session)) {
+				fr_strerror_printf("Failed in TLS handshake");
+				return -1;
+			}
+
+			/*
+			 *	Send the rest of the handshake.  The
+			 *	network calls mod_flush() again when
+			 *	we're done reading.
+			 *
+			 *	@todo - Run the request through a
+			 *	virtual server in order to see if we
+			 *	like the certificate presented by the
+			 *	client.
+			 */
+			if (tls_session->dirty_out.used > 0) {
+				if (mod_queue(conn, tls_session->dirty_out.data, tls_session->dirty_out.used) < 0) return -1;
+				tls_session->dirty_out.used = 0;
+
+				if (mod_flush(conn) < 0) return -1;
+			}
+			continue;
+		}
+
+		if (tls_session_recv(request, tls_session) < 0) {
+		error:
+			fr_strerror_printf("Failed decrypting TLS data");
+			return -1;
+		}
+	}
+
+	return tls_session->record_to_buff(&tls_session->clean_out, buffer, buffer_len);
+}
+#endif
+
+/** Read data from a connection
+ *
+ * @return
+ *	- <0 on error, or if the connection was closed.
+ *	- 0 if there is no data.
+ *	- >0 the amount of data read.
+ */
+static ssize_t mod_recv(proto_radius_tcp_t *conn, uint8_t *buffer, size_t buffer_len)
+{
+	ssize_t rcode;
+
+#ifdef WITH_TLS
+	if (conn->tls_session) return mod_recv_tls(conn, buffer, buffer_len);
+#endif
+
+	rcode = read(conn->sockfd, buffer, buffer_len);
+	if (rcode < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+		fr_strerror_printf("Failed reading from socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if (rcode == 0) {
+		fr_strerror_printf("Connection closed by client");
+		return -1;
+	}
+
+	return rcode;
+}
+
+/** Read a packet from a connection
+ *
+ *  Packets may arrive in pieces, so we read the header, and then the
+ *  rest of the packet, and keep track of how much we have.  When
+ *  there's no more data, we return 0, and the network calls us again
+ *  with the same buffer.
+ *
+ *  Packets which are ignored are skipped here, so that we only return
+ *  0 when there's nothing left to read.  Packets which aren't RADIUS
+ *  close the connection, as we can no longer tell where the next
+ *  packet starts.
+ */
+static ssize_t mod_read(void const *instance, void **packet_ctx, fr_time_t **recv_time, uint8_t *buffer, size_t buffer_len)
+{
+	proto_radius_tcp_t		*conn;
+	ssize_t				data_size;
+	size_t				packet_len;
+	decode_fail_t			reason;
+
+	fr_tracking_status_t		tracking_status;
+	fr_tracking_entry_t		*track;
+
+	memcpy(&conn, &instance, sizeof(conn)); /* const issues */
+
+	conn = talloc_get_type_abort(conn, proto_radius_tcp_t);
+
+	rad_assert(conn->listener != NULL);
+
+	if (buffer_len < MAX_PACKET_LEN) {
+		fr_strerror_printf("Buffer is too small for a packet");
+		return -1;
+	}
+
+	for (;;) {
+		size_t want;
+
+		if (conn->partial < 20) {
+			want = 20 - conn->partial;
+
+		} else {
+			packet_len = (buffer[2] << 8) | buffer[3];
+			if ((packet_len < 20) || (packet_len > MAX_PACKET_LEN)) {
+				fr_strerror_printf("Invalid packet length %zu from client %pV:%u", packet_len,
+						   fr_box_ipaddr(conn->address.src_ipaddr), conn->address.src_port);
+				return -1;
+			}
+
+			want = packet_len - conn->partial;
+		}
+
+		if (want > 0) {
+			data_size = mod_recv(conn, buffer + conn->partial, want);
+			if (data_size <= 0) return data_size;
+
+			conn->partial += data_size;
+			continue;
+		}
+
+		conn->partial = 0;
+
+		/*
+		 *	If it's not a RADIUS packet, close the
+		 *	connection.
+		 */
+		if (!fr_radius_ok(buffer, &packet_len, false, &reason)) return -1;
+
+		/*
+		 *	A code we don't have a "type" for is dropped,
+		 *	rather than closing the connection.
+		 */
+		if (!conn->parent->code_allowed[buffer[0]]) continue;
+
+		/*
+		 *	If the signature fails validation, ignore the
+		 *	packet.
+		 */
+		if (fr_radius_verify(buffer, NULL,
+				     (uint8_t const *)conn->address.client->secret,
+				     talloc_array_length(conn->address.client->secret) - 1,
+				     conn->address.client->hmac_key) < 0) {
+			continue;
+		}
+
+		conn->address.timestamp = fr_time();
+
+		tracking_status = fr_radius_tracking_entry_insert(&track, conn->ft, buffer,
+								  conn->address.timestamp, &conn->address);
+		switch (tracking_status) {
+		case FR_TRACKING_ERROR:
+		case FR_TRACKING_UNUSED:
+			return -1;	/* Fatal */
+
+		/*
+		 *	A duplicate of a packet we're still
+		 *	processing.
+		 */
+		case FR_TRACKING_SAME:
+			continue;
+
+		case FR_TRACKING_DIFFERENT:
+		case FR_TRACKING_NEW:
+			break;
+		}
+
+		*packet_ctx = track;
+		*recv_time = &track->timestamp;
+
+		return packet_len;
+	}
+}
+
+static ssize_t mod_write(void const *instance, void *packet_ctx,
+			 fr_time_t request_time, uint8_t *buffer, size_t buffer_len)
+{
+	proto_radius_tcp_t		*conn;
+	fr_tracking_entry_t		*track = packet_ctx;
+
+	memcpy(&conn, &instance, sizeof(conn)); /* const issues */
+
+	conn = talloc_get_type_abort(conn, proto_radius_tcp_t);
+
+	/*
+	 *	The original packet has changed.  Suppress the write,
+	 *	as the client will never accept the response.
+	 */
+	if (track->timestamp != request_time) return buffer_len;
+
+	/*
+	 *	Only write replies if they're RADIUS packets.
+	 *	sometimes we want to NOT send a reply...
+	 *
+	 *	The replies are queued, to be written by mod_flush().
+	 */
+	if ((buffer_len >= 20) && (conn->sockfd >= 0)) {
+#ifdef WITH_TLS
+		if (conn->tls_session) {
+			tls_session_t *tls_session = conn->tls_session;
+
+			tls_session->record_from_buff(&tls_session->clean_in, buffer, buffer_len);
+			if (!tls_session_send(conn->request, tls_session)) {
+				fr_strerror_printf("Failed encrypting reply");
+			error:
+				(void) fr_radius_tracking_entry_delete(conn->ft, track);
+				return -1;
+			}
+
+			if (mod_queue(conn, tls_session->dirty_out.data, tls_session->dirty_out.used) < 0) goto error;
+			tls_session->dirty_out.used = 0;
+		} else
+#endif
+		if (mod_queue(conn, buffer, buffer_len) < 0) {
+			(void) fr_radius_tracking_entry_delete(conn->ft, track);
+			return -1;
+		}
+	}
+
+	/*
+	 *	Clients don't retransmit on the same connection, so
+	 *	there's no need to keep the reply.
+	 */
+	(void) fr_radius_tracking_entry_delete(conn->ft, track);
+
+	return buffer_len;
+}
+
+/** Open a TCP listener for RADIUS
+ *
+ * @param[in] instance of the RADIUS TCP I/O path.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int mod_open(void *instance)
+{
+	proto_radius_tcp_t *inst = talloc_get_type_abort(instance, proto_radius_tcp_t);
+
+	int				sockfd = 0;
+	uint16_t			port = inst->port;
+
+	sockfd = fr_socket_server_tcp(&inst->ipaddr, &port, inst->port_name, true);
+	if (sockfd < 0) {
+		ERROR("Failed opening TCP socket: %s", fr_strerror());
+	error:
+		return -1;
+	}
+
+	if (fr_socket_bind(sockfd, &inst->ipaddr, &port, inst->interface) < 0) {
+		ERROR("Failed binding socket: %s", fr_strerror());
+	close_error:
+		close(sockfd);
+		goto error;
+	}
+
+	if (listen(sockfd, 8) < 0) {
+		ERROR("Failed listening on socket: %s", fr_syserror(errno));
+		goto close_error;
+	}
+
+	inst->sockfd = sockfd;
+
+	return 0;
+}
+
+#ifdef WITH_TLS
+/** Check whether TLS has decrypted, or can decrypt, data without reading the socket
+ *
+ * @param[in] instance of the RADIUS TCP connection.
+ * @return
+ *	- 0 if there is nothing buffered.
+ *	- 1 if there is data to read.
+ */
+static int mod_pending(void const *instance)
+{
+	proto_radius_tcp_t *conn = talloc_get_type_abort(instance, proto_radius_tcp_t);
+	tls_session_t *tls_session = conn->tls_session;
+
+	if (!tls_session || !SSL_is_init_finished(tls_session->ssl)) return 0;
+
+	if (tls_session->clean_out.used || SSL_pending(tls_session->ssl) ||
+	    BIO_ctrl_pending(tls_session->into_ssl)) return 1;
+
+	return 0;
+}
+#endif
+
+/** Get the file descriptor for this socket.
+ *
+ * @param[in] instance of the RADIUS TCP I/O path.
+ * @return the file descriptor
+ */
+static int mod_fd(void const *instance)
+{
+	proto_radius_tcp_t *inst = talloc_get_type_abort(instance, proto_radius_tcp_t);
+
+	return inst->sockfd;
+}
+
+/** Close a connection, or the listening socket
+ *
+ *  The tracking table is kept until the connection is freed, as
+ *  workers may still be processing requests from it.
+ *
+ * @param[in] instance of the RADIUS TCP I/O path.
+ * @return
+ *	- 0 on success.
+ */
+static int mod_close(void const *instance)
+{
+	proto_radius_tcp_t *inst;
+
+	memcpy(&inst, &instance, sizeof(inst)); /* const issues */
+
+	inst = talloc_get_type_abort(inst, proto_radius_tcp_t);
+
+	if (inst->sockfd < 0) return 0;
+
+	(void) mod_flush(inst);
+
+#ifdef WITH_TLS
+	if (inst->tls_session) SSL_shutdown(inst->tls_session->ssl);
+#endif
+
+	close(inst->sockfd);
+	inst->sockfd = -1;
+
+	if (inst->listener) inst->listener->num_connections--;
+
+	return 0;
+}
+
+static int _connection_free(proto_radius_tcp_t *conn)
+{
+	(void) mod_close(conn);
+
+	return 0;
+}
+
+/** Accept a new connection
+ *
+ *  The client is checked here, rather than for every packet.
+ */
+static int mod_accept(void **connection, TALLOC_CTX *ctx, void const *instance)
+{
+	proto_radius_tcp_t		*inst, *conn;
+	int				newfd;
+	struct sockaddr_storage		src;
+	socklen_t			salen = sizeof(src);
+	RADCLIENT			*client;
+
+	memcpy(&inst, &instance, sizeof(inst)); /* const issues */
+
+	inst = talloc_get_type_abort(inst, proto_radius_tcp_t);
+
+	newfd = accept(inst->sockfd, (struct sockaddr *) &src, &salen);
+	if (newfd < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+		fr_strerror_printf("Failed accepting connection: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	conn = talloc_zero(ctx, proto_radius_tcp_t);
+	if (!conn) {
+		close(newfd);
+		fr_strerror_printf("Failed allocating memory");
+		return -1;
+	}
+
+	conn->parent = inst->parent;
+	conn->sockfd = newfd;
+	conn->listener = inst;
+	conn->port = inst->port;
+	talloc_set_destructor(conn, _connection_free);
+
+	inst->num_connections++;
+
+	if ((inst->max_connections != 0) && (inst->num_connections > inst->max_connections)) {
+		INFO("Ignoring new connection due to socket max_connections (%u)", inst->max_connections);
+	error:
+		talloc_free(conn);
+		return 0;
+	}
+
+	if (fr_nonblock(newfd) < 0) {
+		fr_strerror_printf("Failed setting socket to non-blocking: %s", fr_syserror(errno));
+		talloc_free(conn);
+		return -1;
+	}
+
+	if (fr_ipaddr_from_sockaddr(&src, salen, &conn->address.src_ipaddr, &conn->address.src_port) < 0) {
+		DEBUG2("Ignoring connection from unknown address family");
+		goto error;
+	}
+
+	salen = sizeof(src);
+	if ((getsockname(newfd, (struct sockaddr *) &src, &salen) < 0) ||
+	    (fr_ipaddr_from_sockaddr(&src, salen, &conn->address.dst_ipaddr, &conn->address.dst_port) < 0)) {
+		conn->address.dst_ipaddr = inst->ipaddr;
+		conn->address.dst_port = inst->port;
+	}
+
+	/*
+	 *	Lookup the client - Must exist to continue.
+	 */
+	client = client_find(NULL, &conn->address.src_ipaddr, IPPROTO_TCP);
+	if (!client) {
+		ERROR("Unknown client at address %pV:%u.  Ignoring...",
+		      fr_box_ipaddr(conn->address.src_ipaddr), conn->address.src_port);
+		goto error;
+	}
+	conn->address.client = client;
+
+#ifdef WITH_TLS
+	/*
+	 *	Marking a client as "tls required" means that any
+	 *	accidental exposure of the client to non-TLS traffic
+	 *	is prevented.
+	 */
+	if (client->tls_required && !inst->tls) {
+		INFO("Ignoring connection to TCP socket from TLS client %pV:%u",
+		     fr_box_ipaddr(conn->address.src_ipaddr), conn->address.src_port);
+		goto error;
+	}
+#endif
+
+	conn->ft = fr_radius_tracking_create(conn, sizeof(proto_radius_tcp_address_t),
+					     offsetof(proto_radius_tcp_address_t, timestamp), inst->parent->code_allowed);
+	if (!conn->ft) {
+		fr_strerror_printf("Failed allocating tracking table");
+	fail:
+		talloc_free(conn);
+		return -1;
+	}
+
+#ifdef WITH_TLS
+	/*
+	 *	Allocate a REQUEST for debugging, and initialize the
+	 *	TLS session.
+	 */
+	if (inst->tls) {
+		REQUEST *request;
+
+		conn->request = request = request_alloc(conn);
+		if (!request) {
+			fr_strerror_printf("Failed allocating memory");
+			goto fail;
+		}
+
+		request->packet = fr_radius_alloc(request, false);
+		request->reply = fr_radius_alloc(request, false);
+		if (!request->packet || !request->reply) {
+			fr_strerror_printf("Failed allocating memory");
+			goto fail;
+		}
+
+		request->packet->sockfd = newfd;
+		request->packet->src_ipaddr = conn->address.src_ipaddr;
+		request->packet->src_port = conn->address.src_port;
+		request->packet->dst_ipaddr = conn->address.dst_ipaddr;
+		request->packet->dst_port = conn->address.dst_port;
+
+		request->client = client;
+		request->root = &main_config;
+		request->component = "<tls-connect>";
+
+		conn->tls_session = tls_session_init_server(conn, inst->tls, request, inst->tls->require_client_cert);
+		if (!conn->tls_session) {
+			fr_strerror_printf("Failed initializing TLS session");
+			goto fail;
+		}
+
+		SSL_set_ex_data(conn->tls_session->ssl, FR_TLS_EX_INDEX_REQUEST, (void *)request);
+	}
+#endif
+
+	DEBUG2("Accepted connection from client %pV:%u on socket %d",
+	       fr_box_ipaddr(conn->address.src_ipaddr), conn->address.src_port, newfd);
+
+	*connection = conn;
+	return 1;
+}
+
+static int mod_instantiate(void *instance, CONF_SECTION *cs)
+{
+	proto_radius_tcp_t	*inst = talloc_get_type_abort(instance, proto_radius_tcp_t);
+	CONF_SECTION		*tls_cs;
+
+	inst->sockfd = -1;
+
+	/*
+	 *	Default to all IPv6 interfaces (it's the future)
+	 */
+	if (!inst->ipaddr_is_set && !inst->ipv4addr_is_set && !inst->ipv6addr_is_set) {
+		inst->ipaddr.af = AF_INET6;
+		inst->ipaddr.prefix = 128;
+		inst->ipaddr.addr.v6 = in6addr_any;	/* in6addr_any binds to all addresses */
+	}
+
+	if (!inst->port) {
+		struct servent *s;
+
+		if (!inst->port_name) {
+			cf_log_err(cs, "No 'port' specified in 'tcp' section");
+			return -1;
+		}
+
+		s = getservbyname(inst->port_name, "tcp");
+		if (!s) {
+			cf_log_err(cs, "Unknown value for 'port_name = %s", inst->port_name);
+			return -1;
+		}
+
+		inst->port = ntohl(s->s_port);
+	}
+
+	FR_INTEGER_BOUND_CHECK("max_connections", inst->max_connections, <=, 65535);
+
+	tls_cs = cf_section_find(cs, "tls", NULL);
+	if (tls_cs) {
+#ifdef WITH_TLS
+		inst->tls = tls_conf_parse_server(tls_cs);
+		if (!inst->tls) {
+			cf_log_err(tls_cs, "Failed parsing TLS configuration");
+			return -1;
+		}
+#else
+		cf_log_err(tls_cs, "TLS is not available in this build");
+		return -1;
+#endif
+	}
+
+	return 0;
+}
+
+static int mod_bootstrap(void *instance, UNUSED CONF_SECTION *cs)
+{
+	proto_radius_tcp_t	*inst = talloc_get_type_abort(instance, proto_radius_tcp_t);
+	dl_instance_t const	*dl_inst;
+
+	/*
+	 *	Find the dl_instance_t holding our instance data
+	 *	so we can find out what the parent of our instance
+	 *	was.
+	 */
+	dl_inst = dl_instance_find(instance);
+	rad_assert(dl_inst);
+
+	inst->parent = talloc_get_type_abort(dl_inst->parent->data, proto_radius_t);
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	proto_radius_tcp_t	*inst = talloc_get_type_abort(instance, proto_radius_tcp_t);
+
+	if (inst->sockfd >= 0) close(inst->sockfd);
+	return 0;
+}
+
+
+/** Private interface for use by proto_radius
+ *
+ */
+extern proto_radius_app_io_t proto_radius_app_io_private;
+proto_radius_app_io_t proto_radius_app_io_private = {
+	.client			= mod_client,
+	.src			= mod_src_address,
+	.dst			= mod_dst_address
+};
+
+extern fr_app_io_t proto_radius_tcp;
+fr_app_io_t proto_radius_tcp = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "radius_tcp",
+	.config			= tcp_listen_config,
+	.inst_size		= sizeof(proto_radius_tcp_t),
+	.detach			= mod_detach,
+	.bootstrap		= mod_bootstrap,
+	.instantiate		= mod_instantiate,
+
+	.default_message_size	= 4096,
+
+	/*
+	 *	Enough to read every packet in a full TLS record of
+	 *	minimum sized packets.  Anything OpenSSL still has
+	 *	buffered is found by mod_pending(), and read on the
+	 *	next pass through the event loop.
+	 */
+	.max_reads		= 1024,
+	.open			= mod_open,
+	.accept			= mod_accept,
+	.close			= mod_close,
+	.read			= mod_read,
+	.decode			= mod_decode,
+	.write			= mod_write,
+	.flush			= mod_flush,
+#ifdef WITH_TLS
+	.pending		= mod_pending,
+#endif
+	.fd			= mod_fd,
+	.client			= mod_client,
+};
@@ -26,6 +26,7 @@
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/protocol.h>
 #include <freeradius-devel/udp.h>
+#include <freeradius-devel/udp_uring.h>
 #include <freeradius-devel/radius/radius.h>
 #include <freeradius-devel/io/io.h>
 #include <freeradius-devel/io/application.h>
@@ -34,6 +35,9 @@
 #include <freeradius-devel/rad_assert.h>
 #include "proto_radius.h"
 
+/*
+ *	Everything before "timestamp" is the key for the tracking table.
+ */
 typedef struct {
 	int				if_index;
 
@@ -47,7 +51,22 @@ typedef struct {
 	RADCLIENT			*client;
 } proto_radius_udp_address_t;
 
+/** A batch of datagrams read from, or to be written to, the socket
+ *
+ */
 typedef struct {
+	udp_datagram_t			dg[UDP_BATCH_MAX];	//!< The datagrams.
+	RADCLIENT			*client[UDP_BATCH_MAX];	//!< Client each received datagram came from,
+								///< once it's been verified.
+	uint8_t				*buffer;		//!< "batch" * MAX_PACKET_LEN bytes of packet data.
+	int				num;			//!< Number of datagrams in the batch.
+	int				next;			//!< Next datagram to return from mod_read().
+	bool				refilled;		//!< The batch was read during this readiness event.
+} proto_radius_udp_batch_t;
+
+typedef struct proto_radius_udp_t proto_radius_udp_t;
+
+struct proto_radius_udp_t {
 	proto_radius_t	const		*parent;		//!< The module that spawned us!
 
 	int				sockfd;
@@ -70,7 +89,22 @@ typedef struct {
 
 	fr_tracking_t			*ft;			//!< tracking table
 	uint32_t			cleanup_delay;		//!< cleanup delay for Access-Request packets
-} proto_radius_udp_t;
+
+	uint32_t			batch;			//!< Maximum number of packets to read or write
+								//!< with one system call.
+	proto_radius_udp_batch_t	*rx;			//!< Packets we've read, but not yet returned.
+	proto_radius_udp_batch_t	*tx;			//!< Replies we haven't yet written.
+
+	bool				io_uring;		//!< Read and write packets via io_uring.
+	udp_uring_t			*ur;			//!< The ring, if "io_uring" is set.
+
+	bool				reuse_port;		//!< Open one socket per network thread.
+	bool				steer_by_source;	//!< Send all packets from one client to
+								//!< the same socket.
+	proto_radius_udp_t		*master;		//!< The instance we were copied from,
+								//!< or NULL.
+	uint32_t			num_sockets;		//!< Number of sockets sharing the address.
+};
 
 static const CONF_PARSER udp_listen_config[] = {
 	{ FR_CONF_IS_SET_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, proto_radius_udp_t, ipaddr) },
@@ -85,6 +119,12 @@ static const CONF_PARSER udp_listen_config[] = {
 
 	{ FR_CONF_OFFSET("cleanup_delay", FR_TYPE_UINT32, proto_radius_udp_t, cleanup_delay), .dflt = "5" },
 
+	{ FR_CONF_OFFSET("batch", FR_TYPE_UINT32, proto_radius_udp_t, batch), .dflt = "32" },
+	{ FR_CONF_OFFSET("io_uring", FR_TYPE_BOOL, proto_radius_udp_t, io_uring), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("reuse_port", FR_TYPE_BOOL, proto_radius_udp_t, reuse_port), .dflt = "no" },
+	{ FR_CONF_OFFSET("steer_by_source", FR_TYPE_BOOL, proto_radius_udp_t, steer_by_source), .dflt = "yes" },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -145,6 +185,34 @@ static RADCLIENT *mod_client(UNUSED void const *instance, void const *packet_ctx
 	return address->client;
 }
 
+/** Copy the tracking entry of a packet which is being mirrored
+ *
+ *  The copy isn't in the tracking table, so the original can be
+ *  replied to, and deleted, while the mirrored request is running.
+ */
+static void *mod_mirror(TALLOC_CTX *ctx, UNUSED void const *instance, void const *packet_ctx)
+{
+	fr_tracking_entry_t const	*track = packet_ctx;
+	fr_tracking_entry_t		*copy;
+
+	rad_assert(track->src_dst_size == sizeof(proto_radius_udp_address_t));
+
+	copy = talloc_zero(ctx, fr_tracking_entry_t);
+	if (!copy) return NULL;
+
+	copy->src_dst = talloc_memdup(copy, track->src_dst, track->src_dst_size);
+	if (!copy->src_dst) {
+		talloc_free(copy);
+		return NULL;
+	}
+	copy->src_dst_size = track->src_dst_size;
+	copy->timestamp = track->timestamp;
+	copy->hash = track->hash;
+	memcpy(copy->data, track->data, sizeof(copy->data));
+
+	return copy;
+}
+
 static int mod_decode(UNUSED void const *instance, REQUEST *request, UNUSED uint8_t *const data, UNUSED size_t data_len)
 {
 
@@ -172,55 +240,114 @@ static int mod_decode(UNUSED void const *instance, REQUEST *request, UNUSED uint
 	return 0;
 }
 
-static ssize_t mod_read(void const *instance, void **packet_ctx, fr_time_t **recv_time, uint8_t *buffer, size_t buffer_len)
+/** Check a packet before it is passed to a worker
+ *
+ *  This is the cheap filter which runs in the network thread.
+ *  Packets which aren't RADIUS, which have a code this listener
+ *  doesn't handle, or which come from an unknown client are
+ *  dropped here, before they cost a tracking entry, a message, or a
+ *  trip through the worker.
+ *
+ *  The client list is read-only once the server has started, so
+ *  the lookup needs no locks.
+ *
+ * @param[in] inst		of the RADIUS UDP I/O path.
+ * @param[in] packet		to check.
+ * @param[in,out] packet_len	the size of the data we read, updated
+ *				to the length given in the RADIUS header.
+ * @param[in] src_ipaddr	the packet came from.
+ * @param[in] src_port		the packet came from.
+ * @return
+ *	- The client the packet came from.
+ *	- NULL if the packet should be dropped.
+ */
+static RADCLIENT *mod_filter(proto_radius_udp_t const *inst, uint8_t const *packet, size_t *packet_len,
+			     fr_ipaddr_t const *src_ipaddr, uint16_t src_port)
 {
-	proto_radius_udp_t const	*inst = talloc_get_type_abort(instance, proto_radius_udp_t);
-
-	ssize_t				data_size;
-	size_t				packet_len;
-	decode_fail_t			reason;
-
-	struct timeval			timestamp;
-	fr_tracking_status_t		tracking_status;
-	fr_tracking_entry_t		*track;
-	proto_radius_udp_address_t	address;
-
-	data_size = udp_recv(inst->sockfd, buffer, buffer_len, 0,
-			     &address.src_ipaddr, &address.src_port,
-			     &address.dst_ipaddr, &address.dst_port,
-			     &address.if_index, &timestamp);
-	if (data_size <= 0) return data_size;
-
-	packet_len = data_size;
+	decode_fail_t	reason;
+	RADCLIENT	*client;
 
 	/*
 	 *	If it's not a RADIUS packet, ignore it.
 	 */
-	if (!fr_radius_ok(buffer, &packet_len, false, &reason)) return 0;
+	if (!fr_radius_ok(packet, packet_len, false, &reason)) return NULL;
 
-	address.timestamp = fr_time();
+	/*
+	 *	If we don't have a "type" for it, no worker can
+	 *	process it.  fr_radius_ok() has already checked the
+	 *	code is in range.
+	 */
+	if (!inst->parent->code_allowed[packet[0]]) {
+		DEBUG2("Ignoring %s packet from %pV:%u - not accepted by this listener",
+		       fr_packet_codes[packet[0]], fr_box_ipaddr((*src_ipaddr)), src_port);
+		return NULL;
+	}
 
 	/*
 	 *	Lookup the client - Must exist to continue.
+	 *
+	 *	This is where spoofed and scanning traffic ends up,
+	 *	so don't let it flood the logs.
 	 */
-	address.client = client_find(NULL, &address.src_ipaddr, IPPROTO_UDP);
-	if (!address.client) {
-		ERROR("Unknown client at address %pV:%u.  Ignoring...",
-		      fr_box_ipaddr(address.src_ipaddr), address.src_port);
+	client = client_find(NULL, src_ipaddr, IPPROTO_UDP);
+	if (!client) {
+		RATE_LIMIT(ERROR("Unknown client at address %pV:%u.  Ignoring...",
+				 fr_box_ipaddr((*src_ipaddr)), src_port));
+		return NULL;
+	}
 
-		return 0;
+	return client;
+}
+
+/** Validate and track a packet we've just read
+ *
+ * @param[in] inst		of the RADIUS UDP I/O path.
+ * @param[out] packet_ctx	the tracking entry for the packet.
+ * @param[out] recv_time	when the packet was received.
+ * @param[in] buffer		holding the packet.
+ * @param[in] data_size		of the packet.
+ * @param[in] address		the packet came from.
+ * @param[in] client		the packet came from, if it has already been
+ *				checked by mod_verify_batch().  Otherwise NULL.
+ * @return
+ *	- <0 on fatal error.
+ *	- 0 if the packet should be ignored.
+ *	- >0 the length of the packet.
+ */
+static ssize_t mod_track(proto_radius_udp_t const *inst, void **packet_ctx, fr_time_t **recv_time,
+			 uint8_t *buffer, size_t data_size, proto_radius_udp_address_t *address,
+			 RADCLIENT *client)
+{
+	size_t				packet_len;
+
+	fr_tracking_status_t		tracking_status;
+	fr_tracking_entry_t		*track;
+
+	packet_len = data_size;
+
+	if (client) {
+		address->client = client;
+		address->timestamp = fr_time();
+		goto insert;
 	}
 
+	address->client = mod_filter(inst, buffer, &packet_len, &address->src_ipaddr, address->src_port);
+	if (!address->client) return 0;
+
+	address->timestamp = fr_time();
+
 	/*
 	 *	If the signature fails validation, ignore it.
 	 */
 	if (fr_radius_verify(buffer, NULL,
-			     (uint8_t const *)address.client->secret,
-			     talloc_array_length(address.client->secret)) < 0) {
+			     (uint8_t const *)address->client->secret,
+			     talloc_array_length(address->client->secret) - 1,
+			     address->client->hmac_key) < 0) {
 		return 0;
 	}
 
-	tracking_status = fr_radius_tracking_entry_insert(&track, inst->ft, buffer, address.timestamp, &address);
+insert:
+	tracking_status = fr_radius_tracking_entry_insert(&track, inst->ft, buffer, address->timestamp, address);
 	switch (tracking_status) {
 	case FR_TRACKING_ERROR:
 	case FR_TRACKING_UNUSED:
@@ -271,6 +398,174 @@ static ssize_t mod_read(void const *instance, void **packet_ctx, fr_time_t **rec
 	return packet_len;
 }
 
+/** Check a batch of packets we've just read
+ *
+ *  The packets are filtered, and their clients found, one at a time.
+ *  The signatures are then verified all at once, so that the MD5
+ *  hashes for the whole batch are calculated together.
+ *
+ *  Packets which fail are marked as empty, so that mod_read() skips
+ *  them before copying them into the network's buffer.
+ *
+ * @param[in] inst	of the RADIUS UDP I/O path.
+ * @param[in] rx	the batch to check.
+ */
+static void mod_verify_batch(proto_radius_udp_t const *inst, proto_radius_udp_batch_t *rx)
+{
+	fr_radius_batch_t	batch[UDP_BATCH_MAX];
+	int			idx[UDP_BATCH_MAX];
+	int			i, num = 0;
+
+	for (i = 0; i < rx->num; i++) {
+		udp_datagram_t	*dg = &rx->dg[i];
+		size_t		packet_len = dg->data_len;
+		RADCLIENT	*client;
+
+		rx->client[i] = NULL;
+
+		if (!dg->data_len) continue;
+
+		client = mod_filter(inst, dg->data, &packet_len, &dg->src_ipaddr, dg->src_port);
+		if (!client) {
+			dg->data_len = 0;
+			continue;
+		}
+		dg->data_len = packet_len;
+
+		batch[num].packet = dg->data;
+		batch[num].original = NULL;
+		batch[num].secret = (uint8_t const *)client->secret;
+		batch[num].secret_len = talloc_array_length(client->secret) - 1;
+		batch[num].hmac_key = client->hmac_key;
+
+		rx->client[i] = client;
+		idx[num++] = i;
+	}
+
+	if (!num || (fr_radius_verify_batch(batch, num) == 0)) return;
+
+	/*
+	 *	If the signature fails validation, ignore it.
+	 */
+	for (i = 0; i < num; i++) {
+		if (batch[i].rcode == 0) continue;
+
+		rx->dg[idx[i]].data_len = 0;
+		rx->client[idx[i]] = NULL;
+	}
+}
+
+/** Read a packet from the socket
+ *
+ *  When "batch" is more than one, we read up to "batch" packets
+ *  with one system call, verify them together, and return them one
+ *  at a time.  Packets which are ignored are skipped here, so that
+ *  we only return 0 when there's nothing left to read.
+ *
+ *  When "io_uring" is set, the batch comes from the ring instead
+ *  of the socket.
+ */
+static ssize_t mod_read(void const *instance, void **packet_ctx, fr_time_t **recv_time, uint8_t *buffer, size_t buffer_len)
+{
+	proto_radius_udp_t const	*inst = talloc_get_type_abort(instance, proto_radius_udp_t);
+	proto_radius_udp_batch_t	*rx = inst->rx;
+
+	ssize_t				data_size;
+	struct timeval			timestamp;
+	proto_radius_udp_address_t	address;
+
+	/*
+	 *	The leading fields are the tracking key, so the
+	 *	padding between them has to be zero.
+	 */
+	memset(&address, 0, sizeof(address));
+
+	if (!rx) {
+		data_size = udp_recv(inst->sockfd, buffer, buffer_len, 0,
+				     &address.src_ipaddr, &address.src_port,
+				     &address.dst_ipaddr, &address.dst_port,
+				     &address.if_index, &timestamp);
+		if (data_size <= 0) return data_size;
+
+		return mod_track(inst, packet_ctx, recv_time, buffer, data_size, &address, NULL);
+	}
+
+	for (;;) {
+		udp_datagram_t *dg;
+
+		/*
+		 *	Read at most one batch for each readiness
+		 *	event.  If there's more data, the socket will
+		 *	be readable again, and we'll get called again.
+		 */
+		if (rx->next == rx->num) {
+			int i, rcode;
+
+			if (rx->refilled) {
+				rx->refilled = false;
+				return 0;
+			}
+
+			rx->num = rx->next = 0;
+
+			if (inst->ur) {
+				rcode = udp_uring_recv(inst->ur, rx->dg, inst->batch);
+			} else {
+				for (i = 0; i < (int) inst->batch; i++) {
+					rx->dg[i].data = rx->buffer + (i * MAX_PACKET_LEN);
+					rx->dg[i].data_len = MAX_PACKET_LEN;
+				}
+
+				rcode = udp_recv_batch(inst->sockfd, rx->dg, inst->batch);
+			}
+			if (rcode <= 0) return rcode;
+
+			rx->num = rcode;
+			rx->refilled = true;
+
+			mod_verify_batch(inst, rx);
+		}
+
+		dg = &rx->dg[rx->next++];
+		if (!dg->data_len || (dg->data_len > buffer_len)) continue;
+
+		memcpy(buffer, dg->data, dg->data_len);
+
+		address.src_ipaddr = dg->src_ipaddr;
+		address.src_port = dg->src_port;
+		address.dst_ipaddr = dg->dst_ipaddr;
+		address.dst_port = dg->dst_port;
+		address.if_index = dg->if_index;
+
+		data_size = mod_track(inst, packet_ctx, recv_time, buffer, dg->data_len, &address,
+				      rx->client[rx->next - 1]);
+		if (data_size != 0) return data_size;
+	}
+}
+
+/** Write any queued replies
+ *
+ * @param[in] instance of the RADIUS UDP I/O path.
+ * @return
+ *	- 0 on success.
+ */
+static int mod_flush(void const *instance)
+{
+	proto_radius_udp_t const	*inst = talloc_get_type_abort(instance, proto_radius_udp_t);
+	proto_radius_udp_batch_t	*tx = inst->tx;
+
+	if (!tx || !tx->num) return 0;
+
+	if (inst->ur) {
+		(void) udp_uring_send(inst->ur, tx->dg, tx->num);
+	} else {
+		(void) udp_send_batch(inst->sockfd, tx->dg, tx->num);
+	}
+	tx->num = 0;
+
+	return 0;
+}
+
 static ssize_t mod_write(void const *instance, void *packet_ctx,
 			 fr_time_t request_time, uint8_t *buffer, size_t buffer_len)
 {
@@ -297,7 +592,34 @@ static ssize_t mod_write(void const *instance, void *packet_ctx,
 	 *	Only write replies if they're RADIUS packets.
 	 *	sometimes we want to NOT send a reply...
 	 */
-	if (buffer_len >= 20) {
+	if ((buffer_len >= 20) && inst->tx) {
+		proto_radius_udp_batch_t	*tx = inst->tx;
+		udp_datagram_t			*dg;
+
+		/*
+		 *	Queue the reply, to be written by mod_flush().
+		 */
+		if (tx->num == (int) inst->batch) (void) mod_flush(inst);
+
+		if (buffer_len > MAX_PACKET_LEN) {
+			fr_strerror_printf("Reply is too large (%zu bytes)", buffer_len);
+			return -1;
+		}
+
+		dg = &tx->dg[tx->num++];
+		dg->data = tx->buffer + ((tx->num - 1) * MAX_PACKET_LEN);
+		dg->data_len = buffer_len;
+		memcpy(dg->data, buffer, buffer_len);
+
+		dg->src_ipaddr = address->dst_ipaddr;
+		dg->src_port = address->dst_port;
+		dg->dst_ipaddr = address->src_ipaddr;
+		dg->dst_port = address->src_port;
+		dg->if_index = address->if_index;
+
+		data_size = buffer_len;
+
+	} else if (buffer_len >= 20) {
 		data_size = udp_send(inst->sockfd, buffer, buffer_len, 0,
 				     &address->dst_ipaddr, address->dst_port,
 				     address->if_index,
@@ -368,17 +690,52 @@ static int mod_open(void *instance)
 		return -1;
 	}
 
+	if (inst->reuse_port && (fr_socket_reuse_port(sockfd) < 0)) {
+		ERROR("Failed opening UDP socket: %s", fr_strerror());
+		close(sockfd);
+		goto error;
+	}
+
 	if (fr_socket_bind(sockfd, &inst->ipaddr, &port, inst->interface) < 0) {
 		ERROR("Failed binding socket: %s", fr_strerror());
+		close(sockfd);
 		goto error;
 	}
 
 	inst->sockfd = sockfd;
 
+	if (inst->io_uring) {
+		inst->ur = udp_uring_alloc(inst, sockfd, inst->batch, MAX_PACKET_LEN);
+		if (!inst->ur) {
+			ERROR("Failed opening io_uring: %s", fr_strerror());
+			close(sockfd);
+			inst->sockfd = -1;
+			goto error;
+		}
+	}
+
+	/*
+	 *	Duplicate detection needs retransmissions to be read
+	 *	by the same socket as the original packet.  The
+	 *	kernel's default hash does that as long as the client
+	 *	keeps its source port.  The filter doesn't depend on
+	 *	the source port.  So failing to install it isn't fatal.
+	 */
+	if (inst->reuse_port && inst->steer_by_source) {
+		proto_radius_udp_t *master = inst->master ? inst->master : inst;
+
+		if (fr_socket_reuse_port_steer(sockfd, master->num_sockets) < 0) {
+			WARN("Packets will not be steered by source address: %s", fr_strerror());
+		}
+	}
+
 	return 0;
 }
 
 /** Get the file descriptor for this socket.
+ *
+ *  When "io_uring" is set, this is the ring, which is readable
+ *  whenever the socket has packets for us.
  *
  * @param[in] instance of the RADIUS UDP I/O path.
  * @return the file descriptor
@@ -387,9 +744,35 @@ static int mod_fd(void const *instance)
 {
 	proto_radius_udp_t *inst = talloc_get_type_abort(instance, proto_radius_udp_t);
 
+	if (inst->ur) return udp_uring_fd(inst->ur);
+
 	return inst->sockfd;
 }
 
+/** Close the socket, and the ring if there is one.
+ *
+ * @param[in] instance of the RADIUS UDP I/O path.
+ * @return
+ *	- 0 on success.
+ */
+static int mod_close(void const *instance)
+{
+	proto_radius_udp_t *inst;
+
+	memcpy(&inst, &instance, sizeof(inst)); /* const issues */
+
+	inst = talloc_get_type_abort(inst, proto_radius_udp_t);
+
+	(void) mod_flush(inst);
+
+	TALLOC_FREE(inst->ur);
+
+	if (inst->sockfd >= 0) close(inst->sockfd);
+	inst->sockfd = -1;
+
+	return 0;
+}
+
 
 /** Set the event list for a new socket
  *
@@ -418,6 +801,89 @@ static void mod_event_list_set(void const *instance, fr_event_list_t *el)
 }
 
 
+/** Allocate the per-socket state
+ *
+ * @param[in] inst of the RADIUS UDP I/O path.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int mod_state_alloc(proto_radius_udp_t *inst)
+{
+	inst->ft = fr_radius_tracking_create(inst, sizeof(proto_radius_udp_address_t),
+					     offsetof(proto_radius_udp_address_t, timestamp), inst->parent->code_allowed);
+	if (!inst->ft) return -1;
+
+	if ((inst->batch == 1) && !inst->io_uring) return 0;
+
+	inst->rx = talloc_zero(inst, proto_radius_udp_batch_t);
+	inst->tx = talloc_zero(inst, proto_radius_udp_batch_t);
+	if (!inst->rx || !inst->tx) {
+	oom:
+		fr_strerror_printf("Failed allocating batch buffers");
+		return -1;
+	}
+
+	inst->rx->buffer = talloc_array(inst->rx, uint8_t, inst->batch * MAX_PACKET_LEN);
+	if (!inst->rx->buffer) goto oom;
+
+	inst->tx->buffer = talloc_array(inst->tx, uint8_t, inst->batch * MAX_PACKET_LEN);
+	if (!inst->tx->buffer) goto oom;
+
+	return 0;
+}
+
+static int mod_shard_free(proto_radius_udp_t *inst)
+{
+	(void) mod_flush(inst);
+
+	if (inst->sockfd >= 0) close(inst->sockfd);
+
+	return 0;
+}
+
+/** Create another socket instance for the same address
+ *
+ *  Each instance has its own socket, tracking table, and batches,
+ *  so that it can be used by a different network thread.
+ */
+static int mod_shard(void **shard, TALLOC_CTX *ctx, void const *instance)
+{
+	proto_radius_udp_t	*inst, *master;
+
+	memcpy(&master, &instance, sizeof(master)); /* const issues */
+
+	master = talloc_get_type_abort(master, proto_radius_udp_t);
+
+	if (!master->reuse_port) return 0;
+
+	inst = talloc_zero(ctx, proto_radius_udp_t);
+	if (!inst) {
+		fr_strerror_printf("Failed allocating memory");
+		return -1;
+	}
+
+	*inst = *master;
+	inst->master = master;
+	inst->sockfd = -1;
+	inst->el = NULL;
+	inst->ft = NULL;
+	inst->rx = NULL;
+	inst->tx = NULL;
+	inst->ur = NULL;
+
+	if (mod_state_alloc(inst) < 0) {
+		talloc_free(inst);
+		return -1;
+	}
+	talloc_set_destructor(inst, mod_shard_free);
+
+	master->num_sockets++;
+
+	*shard = inst;
+	return 1;
+}
+
 static int mod_instantiate(void *instance, CONF_SECTION *cs)
 {
 	proto_radius_udp_t *inst = talloc_get_type_abort(instance, proto_radius_udp_t);
@@ -455,9 +921,14 @@ static int mod_instantiate(void *instance, CONF_SECTION *cs)
 
 	FR_INTEGER_BOUND_CHECK("cleanup_delay", inst->cleanup_delay, <=, 30);
 
-	inst->ft = fr_radius_tracking_create(inst, sizeof(proto_radius_udp_address_t), inst->parent->code_allowed);
-	if (!inst->ft) {
-		cf_log_err(cs, "Failed to create tracking table: %s", fr_strerror());
+	FR_INTEGER_BOUND_CHECK("batch", inst->batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("batch", inst->batch, <=, UDP_BATCH_MAX);
+
+	inst->num_sockets = 1;
+
+	if (mod_state_alloc(inst) < 0) {
+		cf_log_err(cs, "Failed allocating socket state: %s", fr_strerror());
+		return -1;
 	}
 
 	return 0;
@@ -491,7 +962,11 @@ static int mod_detach(void *instance)
 	 *	delete our child event loop from the parent on close.
 	 */
 
-	close(inst->sockfd);
+	(void) mod_flush(inst);
+
+	TALLOC_FREE(inst->ur);
+
+	if (inst->sockfd >= 0) close(inst->sockfd);
 	return 0;
 }
 
@@ -517,10 +992,16 @@ fr_app_io_t proto_radius_udp = {
 	.instantiate		= mod_instantiate,
 
 	.default_message_size	= 4096,
+	.max_reads		= UDP_BATCH_MAX + 1,
 	.open			= mod_open,
+	.close			= mod_close,
 	.read			= mod_read,
 	.decode			= mod_decode,
 	.write			= mod_write,
+	.flush			= mod_flush,
 	.fd			= mod_fd,
 	.event_list_set		= mod_event_list_set,
+	.client			= mod_client,
+	.mirror			= mod_mirror,
+	.shard			= mod_shard,
 };
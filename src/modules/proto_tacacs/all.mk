@@ -1 +1 @@
-SUBMAKEFILES := libfreeradius-tacacs.mk proto_tacacs.mk
+SUBMAKEFILES := libfreeradius-tacacs.mk proto_tacacs.mk proto_tacacs_base.mk proto_tacacs_tcp.mk
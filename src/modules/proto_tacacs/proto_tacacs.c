@@ -1,8 +1,4 @@
 /*
- * proto_tacacs.c	TACACS+ processing.
- *
- * Version:	$Id$
- *
  *   This program is free software; you can redistribute it and/or modify
  *   it under the terms of the GNU General Public License as published by
  *   the Free Software Foundation; either version 2 of the License, or
@@ -16,591 +12,413 @@
  *   You should have received a copy of the GNU General Public License
  *   along with this program; if not, write to the Free Software
  *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_tacacs.c
+ * @brief TACACS+ master protocol handler.
  *
- * Copyright 2017 The FreeRADIUS server project
- * Copyright 2017 Network RADIUS SARL <info@networkradius.com>
+ * @copyright 2017 The FreeRADIUS server project.
+ * @copyright 2017 Network RADIUS SARL <info@networkradius.com>
  */
 #include <freeradius-devel/radiusd.h>
-#include <freeradius-devel/modules.h>
-#include <freeradius-devel/protocol.h>
-#include <freeradius-devel/process.h>
-#include <freeradius-devel/state.h>
+#include <freeradius-devel/tacacs.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/io/application.h>
 #include <freeradius-devel/rad_assert.h>
+#include "proto_tacacs.h"
 
-#include "tacacs.h"
+extern fr_app_t proto_tacacs;
+static int transport_parse(TALLOC_CTX *ctx, void *out, CONF_ITEM *ci, CONF_PARSER const *rule);
 
-/*
- *	Debug the packet if requested - cribbed from common_packet_debug
+/** How to parse a TACACS+ listen section
+ *
  */
-static void tacacs_packet_debug(REQUEST *request, RADIUS_PACKET *packet, bool received)
-{
-	char src_ipaddr[FR_IPADDR_STRLEN];
-	char dst_ipaddr[FR_IPADDR_STRLEN];
-
-	if (!packet) return;
-	if (!RDEBUG_ENABLED) return;
-
-	radlog_request(L_DBG, L_DBG_LVL_1, request, "%s %s Id %u from %s%s%s:%i to %s%s%s:%i "
-		       "length %zu",
-		       received ? "Received" : "Sending",
-		       tacacs_lookup_packet_code(request->packet),
-		       tacacs_session_id(request->packet),
-		       packet->src_ipaddr.af == AF_INET6 ? "[" : "",
-		       fr_inet_ntop(src_ipaddr, sizeof(src_ipaddr), &packet->src_ipaddr),
-		       packet->src_ipaddr.af == AF_INET6 ? "]" : "",
-		       packet->src_port,
-		       packet->dst_ipaddr.af == AF_INET6 ? "[" : "",
-		       fr_inet_ntop(dst_ipaddr, sizeof(dst_ipaddr), &packet->dst_ipaddr),
-		       packet->dst_ipaddr.af == AF_INET6 ? "]" : "",
-		       packet->dst_port,
-		       packet->data_len);
-
-	rdebug_pair_list(L_DBG_LVL_1, request, packet->vps, NULL);
-}
+static CONF_PARSER const proto_tacacs_config[] = {
+	{ FR_CONF_OFFSET("type", FR_TYPE_STRING | FR_TYPE_MULTI | FR_TYPE_NOT_EMPTY, proto_tacacs_t,
+			  types), .dflt = "Authentication" },
+	{ FR_CONF_OFFSET("transport", FR_TYPE_VOID, proto_tacacs_t, io_submodule),
+	  .func = transport_parse },
+
+	/*
+	 *	For performance tweaking.  NOT for normal humans.
+	 */
+	{ FR_CONF_OFFSET("default_message_size", FR_TYPE_UINT32, proto_tacacs_t, default_message_size) } ,
+	{ FR_CONF_OFFSET("num_messages", FR_TYPE_UINT32, proto_tacacs_t, num_messages) } ,
 
-static void tacacs_status(REQUEST * const request, rlm_rcode_t rcode)
+	CONF_PARSER_TERMINATOR
+};
+
+/** Wrapper around dl_instance
+ *
+ * @param[in] ctx	to allocate data in (instance of proto_tacacs).
+ * @param[out] out	Where to write a dl_instance_t containing the module handle and instance.
+ * @param[in] ci	#CONF_PAIR specifying the name of the type module.
+ * @param[in] rule	unused.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int transport_parse(TALLOC_CTX *ctx, void *out, CONF_ITEM *ci, UNUSED CONF_PARSER const *rule)
 {
-	char const *k = "Unknown";
-	char const *v = "Unknown";
-
-	switch (tacacs_type(request->packet)) {
-	case TAC_PLUS_AUTHEN:
-		k = "TACACS-Authentication-Status";
-		switch (rcode) {
-		case RLM_MODULE_OK:
-			v = "Pass";
-			break;
-		case RLM_MODULE_FAIL:
-		case RLM_MODULE_REJECT:
-		case RLM_MODULE_USERLOCK:
-			v = "Fail";
-			break;
-		case RLM_MODULE_INVALID:
-			v = "Error";
-			break;
-		case RLM_MODULE_HANDLED:	/* unlang set status */
-			return;
-		default:
-noop:
-			WARN("ignoring request to add TACACS status with code %d", rcode);
-			return;
-		}
-		break;
-	case TAC_PLUS_AUTHOR:
-		k = "TACACS-Authorization-Status";
-		switch (rcode) {
-		case RLM_MODULE_OK:
-			v = "Pass-Repl";
-			break;
-		case RLM_MODULE_FAIL:
-		case RLM_MODULE_REJECT:
-		case RLM_MODULE_USERLOCK:
-			v = "Fail";
-			break;
-		case RLM_MODULE_INVALID:
-			v = "Error";
-			break;
-		default:
-			goto noop;
-		}
-		break;
-	case TAC_PLUS_ACCT:
-		k = "TACACS-Accounting-Status";
-		switch (rcode) {
-		case RLM_MODULE_OK:
-			v = "Success";
-			break;
-		case RLM_MODULE_FAIL:
-		case RLM_MODULE_REJECT:
-		case RLM_MODULE_USERLOCK:
-		case RLM_MODULE_INVALID:
-			v = "Error";
-			break;
-		default:
-			goto noop;
-		}
-		break;
-	}
+	char const	*name = cf_pair_value(cf_item_to_pair(ci));
+	dl_instance_t	*parent_inst;
+	CONF_SECTION	*listen_cs = cf_item_to_section(cf_parent(ci));
+	CONF_SECTION	*transport_cs;
+
+	transport_cs = cf_section_find(listen_cs, name, NULL);
+
+	/*
+	 *	Allocate an empty section if one doesn't exist
+	 *	this is so defaults get parsed.
+	 */
+	if (!transport_cs) transport_cs = cf_section_alloc(listen_cs, listen_cs, name, NULL);
 
-	fr_pair_make(request->reply, &request->reply->vps, k, v, T_OP_EQ);
+	parent_inst = cf_data_value(cf_data_find(listen_cs, dl_instance_t, "proto_tacacs"));
+	rad_assert(parent_inst);
+
+	return dl_instance(ctx, out, transport_cs, parent_inst, name, DL_TYPE_SUBMODULE);
 }
 
-static void state_add(REQUEST *request, RADIUS_PACKET *packet)
+/** Decode the packet.
+ *
+ *  The transport fills in the client and the addresses.  The packet
+ *  has already been decrypted, and checked, by the network thread.
+ */
+static int mod_decode(void const *instance, REQUEST *request, uint8_t *const data, size_t data_len)
 {
-	VALUE_PAIR *vp;
-	uint32_t session_id;
-	uint8_t buf[16] = { 0 };	/* FIXME state.c:sizeof(struct state_comp) */
+	proto_tacacs_t const	*inst = talloc_get_type_abort(instance, proto_tacacs_t);
+	RADIUS_PACKET		*packet = request->packet;
 
-	rad_assert(sizeof(request->listener) + sizeof(vp->vp_uint32) <= sizeof(buf));		//-V568
+	if (inst->app_io->decode(inst->app_io_instance, request, data, data_len) < 0) return -1;
 
-	/* session_id is per TCP connection */
-	memcpy(&buf[0], &request->listener, sizeof(request->listener));				//-V568
+	/*
+	 *	The worker holds the message until it's done with the
+	 *	request, so we can decode straight out of it.
+	 */
+	if (request->async->message) {
+		packet->data = data;
+	} else {
+		packet->data = talloc_memdup(packet, data, data_len);
+		if (!packet->data) return -1;
+	}
+	packet->data_len = data_len;
 
-	session_id = tacacs_session_id(request->packet);
-	memcpy(&buf[sizeof(buf) - sizeof(session_id)], &session_id, sizeof(session_id));
+	packet->code = ((tacacs_packet_hdr_t const *)data)->type;
+
+	/*
+	 *	-2 is a client abort, which gets no reply.  The NAK
+	 *	tells the transport to forget the session.
+	 */
+	if (tacacs_decode(packet) < 0) {
+		RDEBUG("Failed decoding packet: %s", fr_strerror());
+		return -1;
+	}
 
-	vp = fr_pair_afrom_num(packet, 0, FR_STATE);
-	rad_assert(vp != NULL);
-	fr_pair_value_memcpy(vp, (uint8_t const *)buf, sizeof(buf));
-	fr_pair_add(&packet->vps, vp);
+	return 0;
 }
 
-static void tacacs_running(REQUEST *request, fr_state_action_t action)
+/** Encode and encrypt the reply
+ *
+ */
+static ssize_t mod_encode(UNUSED void const *instance, REQUEST *request, uint8_t *buffer, size_t buffer_len)
 {
-	rlm_rcode_t rcode;
-	CONF_SECTION *unlang;
-	fr_dict_attr_t const *da;
-	fr_dict_enum_t const *dv = NULL;
-	VALUE_PAIR *vp, *auth_type;
-	vp_cursor_t cursor;
-	int rc;
-
-	VERIFY_REQUEST(request);
-
-	switch (action) {
-	case FR_ACTION_DONE:
-		goto done;
-
-	default:
-		break;
-	}
+	RADIUS_PACKET		*reply = request->reply;
+	char const		*secret = request->client->secret;
 
-	switch (request->request_state) {
-	case REQUEST_INIT:
-		rc = tacacs_decode(request->packet);
-		if (rc == -2)	/* client abort no reply */
-			goto done;
-		else if (rc < 0) {
-			fr_strerror_printf("Failed decoding TACACS+ packet");
-			goto setup_send;
-		}
+	if (tacacs_reply_header(reply, request->packet) < 0) {
+		RDEBUG("Failed creating TACACS+ reply: %s", fr_strerror());
+		return -1;
+	}
 
-		if (RDEBUG_ENABLED) tacacs_packet_debug(request, request->packet, true);
+	if (tacacs_encode(reply, secret) < 0) {
+		RDEBUG("Failed encoding TACACS+ reply: %s", fr_strerror());
+		return -1;
+	}
 
-		request->server_cs = request->listener->server_cs;
-		request->component = "tacacs";
+	/*
+	 *	The client asked to use one connection for many
+	 *	sessions.  Say that we do.
+	 */
+	if (((tacacs_packet_hdr_t const *)request->packet->data)->flags & TAC_PLUS_SINGLE_CONNECT_FLAG) {
+		((tacacs_packet_hdr_t *)reply->data)->flags |= TAC_PLUS_SINGLE_CONNECT_FLAG;
+	}
 
-		unlang = cf_section_find(request->server_cs, "recv", tacacs_lookup_packet_code(request->packet));
-		if (!unlang) unlang = cf_section_find(request->server_cs, "recv", "*");
-		if (!unlang) {
-			REDEBUG("Failed to find 'recv' section");
-			goto setup_send;
-		}
+	rad_assert(tacacs_ok(reply->data, false) == true);
 
-		/* FIXME only for seq_id greater than 1 */
-		if (tacacs_type(request->packet) == TAC_PLUS_AUTHEN) {
-			state_add(request, request->packet);
-			fr_state_to_request(global_state, request, request->packet);
-		}
+	if (tacacs_xor(reply->data, reply->data_len, secret) < 0) {
+		RDEBUG("Failed encrypting TACACS+ reply: %s", fr_strerror());
+		return -1;
+	}
 
-		RDEBUG("Running 'recv %s' from file %s", cf_section_name2(unlang), cf_filename(unlang));
-		unlang_push_section(request, unlang, RLM_MODULE_REJECT);
+	if (reply->data_len > buffer_len) {
+		RDEBUG("Reply is too large for the buffer");
+		return -1;
+	}
 
-		request->request_state = REQUEST_RECV;
-		/* FALL-THROUGH */
+	memcpy(buffer, reply->data, reply->data_len);
 
-	case REQUEST_RECV:
-		rcode = unlang_interpret_continue(request);
+	return reply->data_len;
+}
 
-		if (request->master_state == REQUEST_STOP_PROCESSING) {
-stop_processing:
-			if (tacacs_type(request->packet) == TAC_PLUS_AUTHEN)
-				fr_state_discard(global_state, request, request->packet);
-			goto done;
-		}
+static void mod_process_set(void const *instance, REQUEST *request)
+{
+	proto_tacacs_t const *inst = talloc_get_type_abort(instance, proto_tacacs_t);
+	fr_io_process_t process;
 
-		if (rcode == RLM_MODULE_YIELD) return;
+	request->server_cs = inst->server_cs;
 
-		rad_assert(request->log.unlang_indent == 0);
+	process = inst->process;
+	if (!process) {
+		REDEBUG("No module available to handle packet type %i", request->packet->code);
+		return;
+	}
 
-		switch (rcode) {
-		case RLM_MODULE_NOOP:
-		case RLM_MODULE_NOTFOUND:
-		case RLM_MODULE_OK:
-		case RLM_MODULE_UPDATED:
-			break;
+	request->async->process = process;
+}
 
-		case RLM_MODULE_HANDLED:
-			goto setup_send;
+/** Open listen sockets/connect to external event source
+ *
+ * @param[in] instance	Ctx data for this application.
+ * @param[in] sc	to add our file descriptor to.
+ * @param[in] conf	Listen section parsed to give us isntance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_open(void *instance, fr_schedule_t *sc, CONF_SECTION *conf)
+{
+	fr_listen_t	*listen;
+	proto_tacacs_t 	*inst = talloc_get_type_abort(instance, proto_tacacs_t);
 
-		case RLM_MODULE_FAIL:
-		case RLM_MODULE_INVALID:
-		case RLM_MODULE_REJECT:
-		case RLM_MODULE_USERLOCK:
-		default:
-			tacacs_status(request, rcode);
-			goto setup_send;
-		}
+	/*
+	 *	Build the #fr_listen_t.  This describes the complete
+	 *	path, data takes from the socket to the decoder and
+	 *	back again.
+	 */
+	listen = talloc_zero(inst, fr_listen_t);
 
-		/*
-		 *	Find Auth-Type, and complain if they have too many.
-		 */
-		fr_pair_cursor_init(&cursor, &request->control);
-		auth_type = NULL;
-		while ((vp = fr_pair_cursor_next_by_num(&cursor, 0, FR_AUTH_TYPE, TAG_ANY)) != NULL) {
-			if (!auth_type) {
-				auth_type = vp;
-				continue;
-			}
-
-			RWDEBUG("Ignoring extra Auth-Type = %s",
-				fr_dict_enum_alias_by_value(NULL, auth_type->da, &vp->data));
-		}
+	listen->app_io = inst->app_io;
+	listen->app_io_instance = inst->app_io_instance;
 
-		/*
-		 *	No Auth-Type, force it to reject.
-		 */
-		if (!auth_type) {
-			REDEBUG2("No Auth-Type available: rejecting the user.");
-			tacacs_status(request, RLM_MODULE_REJECT);
-			goto setup_send;
-		}
+	listen->app = &proto_tacacs;
+	listen->app_instance = instance;
+	listen->server_cs = inst->server_cs;
 
-		/*
-		 *	Handle hard-coded Accept and Reject.
-		 */
-		if (auth_type->vp_uint32 == FR_AUTH_TYPE_ACCEPT) {
-			RDEBUG2("Auth-Type = Accept, allowing user");
-			tacacs_status(request, RLM_MODULE_OK);
-			goto setup_send;
-		}
+	/*
+	 *	Set configurable parameters for message ring buffer.
+	 */
+	listen->default_message_size = inst->default_message_size;
+	listen->num_messages = inst->num_messages;
 
-		if (auth_type->vp_uint32 == FR_AUTH_TYPE_REJECT) {
-			RDEBUG2("Auth-Type = Reject, rejecting user");
-			tacacs_status(request, RLM_MODULE_REJECT);
-			goto setup_send;
-		}
+	/*
+	 *	Open the socket, and add it to the scheduler.
+	 */
+	if (inst->app_io) {
+		CONF_PAIR *cp = inst->app_io_conf ? cf_pair_find(inst->app_io_conf, "port") : NULL;
 
 		/*
-		 *	Find the appropriate Auth-Type by name.
+		 *	Name the listener for the metrics.
 		 */
-		vp = auth_type;
-		dv = fr_dict_enum_by_value(NULL, vp->da, &vp->data);
-		if (!dv) {
-			REDEBUG2("Unknown Auth-Type %d found: rejecting the user", vp->vp_uint32);
-			tacacs_status(request, RLM_MODULE_FAIL);
-			goto setup_send;
-		}
-
-		unlang = cf_section_find(request->server_cs, "process", dv->alias);
-		if (!unlang) {
-			REDEBUG2("No 'process %s' section found: rejecting the user.", dv->alias);
-			tacacs_status(request, RLM_MODULE_FAIL);
-			goto setup_send;
+		if (cp && cf_pair_value(cp)) {
+			listen->name = talloc_typed_asprintf(listen, "%s/%s/%s", cf_section_name2(inst->server_cs),
+							     inst->app_io->name, cf_pair_value(cp));
+		} else {
+			listen->name = talloc_typed_asprintf(listen, "%s/%s", cf_section_name2(inst->server_cs),
+							     inst->app_io->name);
 		}
 
-		RDEBUG("Running 'process %s' from file %s", cf_section_name2(unlang), cf_filename(unlang));
-		unlang_push_section(request, unlang, RLM_MODULE_NOTFOUND);
-
-		request->request_state = REQUEST_PROCESS;
-		/* FALL-THROUGH */
-
-	case REQUEST_PROCESS:
-		rcode = unlang_interpret_continue(request);
-
-		if (request->master_state == REQUEST_STOP_PROCESSING) goto stop_processing;
-
-		if (rcode == RLM_MODULE_YIELD) return;
-
-		rad_assert(request->log.unlang_indent == 0);
-
-		switch (rcode) {
-			/*
-			 *	An authentication module FAIL
-			 *	return code, or any return code that
-			 *	is not expected from authentication,
-			 *	is the same as an explicit REJECT!
-			 */
-		case RLM_MODULE_FAIL:
-		case RLM_MODULE_INVALID:
-		case RLM_MODULE_NOOP:
-		case RLM_MODULE_NOTFOUND:
-		case RLM_MODULE_REJECT:
-		case RLM_MODULE_UPDATED:
-		case RLM_MODULE_USERLOCK:
-		default:
-			RDEBUG2("Failed to authenticate the user");
-			tacacs_status(request, RLM_MODULE_FAIL);
-			goto setup_send;
-
-		case RLM_MODULE_OK:
-			tacacs_status(request, RLM_MODULE_OK);
-			break;
-
-		case RLM_MODULE_HANDLED:
-			goto setup_send;
+		if (inst->app_io->open(inst->app_io_instance) < 0) {
+			cf_log_err(conf, "Failed opening %s interface", inst->app_io->name);
+			talloc_free(listen);
+			return -1;
 		}
 
-setup_send:
-		unlang = NULL;
-		if (dv) {
-			unlang = cf_section_find(request->server_cs, "send", tacacs_lookup_packet_code(request->packet));
+		if (!fr_schedule_socket_add(sc, listen)) {
+			talloc_free(listen);
+			return -1;
 		}
-		if (!unlang) unlang = cf_section_find(request->server_cs, "send", "*");
-		if (!unlang) goto send_reply;
-
-		RDEBUG("Running 'send %s' from file %s", cf_section_name2(unlang), cf_filename(unlang));
-		unlang_push_section(request, unlang, RLM_MODULE_NOOP);
-
-		request->request_state = REQUEST_SEND;
-		/* FALL-THROUGH */
-
-	case REQUEST_SEND:
-		rcode = unlang_interpret_continue(request);
-
-		if (request->master_state == REQUEST_STOP_PROCESSING) goto stop_processing;
-
-		if (rcode == RLM_MODULE_YIELD) return;
-
-		rad_assert(request->log.unlang_indent == 0);
-
-send_reply:
-		gettimeofday(&request->reply->timestamp, NULL);
-
-		if (tacacs_type(request->packet) == TAC_PLUS_AUTHEN) {
-			fr_dict_attr_t const *authda;
-
-			authda = fr_dict_attr_by_name(NULL, "TACACS-Authentication-Status");
-			rad_assert(authda != NULL);
-			vp = fr_pair_find_by_da(request->reply->vps, authda, TAG_ANY);
-
-			if (vp) {
-				switch ((tacacs_authen_reply_status_t)vp->vp_uint8) {
-				case TAC_PLUS_AUTHEN_STATUS_PASS:
-				case TAC_PLUS_AUTHEN_STATUS_FAIL:
-				case TAC_PLUS_AUTHEN_STATUS_RESTART:
-				case TAC_PLUS_AUTHEN_STATUS_ERROR:
-				case TAC_PLUS_AUTHEN_STATUS_FOLLOW:
-					fr_state_discard(global_state, request, request->packet);
-					break;
-				default:
-					da = fr_dict_attr_by_name(NULL, "TACACS-Sequence-Number");
-					rad_assert(da != NULL);
-					vp = fr_pair_find_by_da(request->packet->vps, da, TAG_ANY);
-					rad_assert(vp != NULL);
-
-					/* authentication would continue but seq_no cannot continue */
-					if (vp->vp_uint8 == 253) {
-						RWARN("Sequence number would wrap, restarting authentication");
-						fr_state_discard(global_state, request, request->packet);
-						fr_pair_list_free(&request->reply->vps);
-
-						vp = fr_pair_afrom_da(request->reply, authda);
-						rad_assert(vp != NULL);
-						vp->vp_uint8 = (tacacs_authen_reply_status_t)TAC_PLUS_AUTHEN_STATUS_RESTART;
-						fr_pair_add(&request->reply->vps, vp);
-					} else {
-						state_add(request, request->reply);
-						request->reply->code = 1;	/* FIXME: util.c:verify_request() */
-						fr_request_to_state(global_state, request, request->packet, request->reply);
-					}
-				}
-			} else
-				fr_state_discard(global_state, request, request->packet);
-		}
-
-		if (RDEBUG_ENABLED) tacacs_packet_debug(request, request->reply, false);
-
-		if (tacacs_send(request->reply, request->packet, request->client->secret) < 0) {
-			RDEBUG("Failed sending TACACS reply: %s", fr_strerror());
-			goto done;
-		}
-
-		/* FALL-THROUGH */
-
-done:
-	default:
-		(void) fr_heap_extract(request->backlog, request);
-		request_delete(request);
-		break;
 	}
-}
-
-static void tacacs_queued(REQUEST *request, fr_state_action_t action)
-{
-	VERIFY_REQUEST(request);
 
-	switch (action) {
-	case FR_ACTION_RUN:
-		request->process = tacacs_running;
-		request->process(request, action);
-		break;
+	inst->listen = listen;	/* Probably won't need it, but doesn't hurt */
 
-	case FR_ACTION_DONE:
-		(void) fr_heap_extract(request->backlog, request);
-		request_delete(request);
-		break;
-
-	default:
-		break;
-	}
+	return 0;
 }
 
-/*
- *	Check if an incoming request is "ok"
+/** Instantiate the application
+ *
+ * Instantiate I/O and type submodules.
  *
- *	It takes packets, not requests.  It sees if the packet looks
- *	OK.  If so, it does a number of sanity checks on it.
+ * @param[in] instance	Ctx data for this application.
+ * @param[in] conf	Listen section parsed to give us isntance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static int tacacs_socket_recv(rad_listen_t *listener)
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
-	int		rcode;
-	RADIUS_PACKET	*packet;
-	TALLOC_CTX	*ctx;
-	REQUEST		*request;
-	listen_socket_t *sock = listener->data;
-	RADCLIENT	*client = sock->client;
+	proto_tacacs_t		*inst = talloc_get_type_abort(instance, proto_tacacs_t);
+	fr_app_process_t const	*app_process;
 
-	if (!rad_cond_assert(client != NULL)) return 0;
-
-	if (listener->status != RAD_LISTEN_STATUS_KNOWN) return 0;
-
-	ctx = talloc_pool(listener, main_config.talloc_pool_size);
-	if (!ctx) return 0;
-	talloc_set_name_const(ctx, "tacacs_listener_pool");
+	/*
+	 *	The listener is inside of a virtual server.
+	 */
+	inst->server_cs = cf_item_to_section(cf_parent(conf));
 
 	/*
-	 *	Allocate a packet for partial reads.
+	 *	Instantiate the I/O module
 	 */
-	if (!sock->packet) {
-		sock->packet = fr_radius_alloc(ctx, false);
-		if (!sock->packet) return 0;
-
-		sock->packet->sockfd = listener->fd;
-		sock->packet->src_ipaddr = sock->other_ipaddr;
-		sock->packet->src_port = sock->other_port;
-		sock->packet->dst_ipaddr = sock->my_ipaddr;
-		sock->packet->dst_port = sock->my_port;
-		sock->packet->proto = sock->proto;
+	if (inst->app_io && inst->app_io->instantiate &&
+	    (inst->app_io->instantiate(inst->app_io_instance,
+				       inst->app_io_conf) < 0)) {
+		cf_log_err(conf, "Instantiation failed for \"%s\"", inst->app_io->name);
+		return -1;
 	}
 
 	/*
-	 *	Grab the packet currently being processed.
+	 *	Instantiate the process module
 	 */
-	packet = sock->packet;
-
-	rcode = tacacs_read_packet(packet, client->secret);
-	if (rcode == 0) return 0;	/* partial packet */
-	if (rcode == -1) {		/* error reading packet */
-		char buffer[256];
-
-		ERROR("Invalid packet from %s port %d, closing socket: %s",
-		       fr_inet_ntoh(&packet->src_ipaddr, buffer, sizeof(buffer)),
-		       packet->src_port, fr_strerror());
+	app_process = (fr_app_process_t const *)inst->process_submodule->module->common;
+	if (app_process->instantiate && (app_process->instantiate(inst->process_submodule->data,
+								  inst->process_submodule->conf) < 0)) {
+		cf_log_err(conf, "Instantiation failed for \"%s\"", app_process->name);
+		return -1;
 	}
-	if (rcode < 0) {		/* error or connection reset */
-		DEBUG("Client has closed connection");
 
-		listener->status = RAD_LISTEN_STATUS_EOL;
-		radius_update_listener(listener);
+	inst->process = app_process->process;	/* Store the process function */
 
-		return 0;
-	}
-
-	request = request_setup(ctx, listener, packet, client, NULL);
-	if (!request) {
-		talloc_free(ctx);
-		return 0;
-	}
+	/*
+	 *	These configuration items are not printed by default,
+	 *	because normal people shouldn't be touching them.
+	 */
+	if (!inst->default_message_size && inst->app_io) inst->default_message_size = inst->app_io->default_message_size;
 
-	request->process = tacacs_queued;
-	request_enqueue(request);
+	if (!inst->num_messages) inst->num_messages = 256;
 
-	sock->packet = NULL;	/* we have no need for more partial reads */
-	return 1;
-}
+	FR_INTEGER_BOUND_CHECK("num_messages", inst->num_messages, >=, 32);
+	FR_INTEGER_BOUND_CHECK("num_messages", inst->num_messages, <=, 65535);
 
-static int tacacs_socket_error(rad_listen_t *listener, UNUSED int fd)
-{
-	listener->status = RAD_LISTEN_STATUS_EOL;
-	radius_update_listener(listener);
+	FR_INTEGER_BOUND_CHECK("default_message_size", inst->default_message_size, >=, TACACS_MAX_PACKET_SIZE);
+	FR_INTEGER_BOUND_CHECK("default_message_size", inst->default_message_size, <=, 65535);
 
-	return 1;
+	return 0;
 }
 
-static int tacacs_compile_section(CONF_SECTION *server_cs, char const *name1, char const *name2, rlm_components_t component)
+/** Bootstrap the application
+ *
+ * Bootstrap I/O and type submodules.
+ *
+ * @param[in] instance	Ctx data for this application.
+ * @param[in] conf	Listen section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
-	CONF_SECTION *cs;
-	int ret;
+	proto_tacacs_t 		*inst = talloc_get_type_abort(instance, proto_tacacs_t);
+	size_t			i;
+	fr_dict_attr_t const	*da;
+	dl_instance_t		*parent_inst;
+	fr_app_process_t const	*app_process;
 
-	cs = cf_section_find(server_cs, name1, name2);
-	if (!cs) {
-		cf_log_err(server_cs, "Failed finding '%s %s { ... }' section of virtual server %s",
-			name1, name2, cf_section_name2(server_cs));
-		return -1;
-	}
-
-	cf_log_debug(cs, "Loading %s %s {...}", name1, name2);
-
-	ret = unlang_compile(cs, component);
-	if (ret < 0) {
-		cf_log_err(cs, "Failed compiling '%s %s { ... }' section", name1, name2);
+	/*
+	 *	Needed to populate the code array
+	 */
+	da = fr_dict_attr_child_by_num(dict_tacacs_root, FR_TACACS_PACKET_TYPE);
+	if (!da) {
+		ERROR("Missing definiton for TACACS-Packet-Type");
 		return -1;
 	}
 
-	return 0;
-}
-
-static int tacacs_listen_compile(CONF_SECTION *server_cs, UNUSED CONF_SECTION *listen_cs)
-{
-	int rcode;
-	CONF_SECTION *subcs = NULL;
+	for (i = 0; i < talloc_array_length(inst->types); i++) {
+		fr_dict_enum_t const	*type_enum;
+		uint8_t			code;
 
-	rcode = tacacs_compile_section(server_cs, "recv", "Authentication", MOD_AUTHORIZE);
-	if (rcode < 0) return rcode;
+		type_enum = fr_dict_enum_by_alias(NULL, da, inst->types[i]);
+		if (!type_enum) {
+			cf_log_err(conf, "Invalid type \"%s\"", inst->types[i]);
+			return -1;
+		}
 
-	rcode = tacacs_compile_section(server_cs, "send", "Authentication", MOD_POST_AUTH);
-	if (rcode < 0) return rcode;
+		code = type_enum->value->vb_uint8;
+		if ((code < TAC_PLUS_AUTHEN) || (code > TAC_PLUS_ACCT)) {
+			cf_log_err(conf, "Cannot listen for TACACS-Packet-Type = '%s'", inst->types[i]);
+			return -1;
+		}
 
-	rcode = tacacs_compile_section(server_cs, "recv", "Authorization", MOD_AUTHORIZE);
-	if (rcode < 0) return rcode;
+		inst->code_allowed[code] = true;
+	}
 
-	rcode = tacacs_compile_section(server_cs, "send", "Authorization", MOD_POST_AUTH);
-	if (rcode < 0) return rcode;
+	/*
+	 *	All of the packet types use the same process
+	 *	module, which looks up "recv <type>" sections.
+	 *
+	 *	Parent dl_instance_t added in virtual_servers.c (listen_parse)
+	 */
+	parent_inst = cf_data_value(cf_data_find(conf, dl_instance_t, "proto_tacacs"));
+	rad_assert(parent_inst);
 
-	rcode = tacacs_compile_section(server_cs, "recv", "Accounting", MOD_PREACCT);
-	if (rcode < 0) return rcode;
+	if (dl_instance(inst, &inst->process_submodule, conf, parent_inst, "base", DL_TYPE_SUBMODULE) < 0) {
+		cf_log_err(conf, "Failed loading process module: %s", fr_strerror());
+		return -1;
+	}
 
-	rcode = tacacs_compile_section(server_cs, "send", "Accounting", MOD_ACCOUNTING);
-	if (rcode < 0) return rcode;
+	app_process = (fr_app_process_t const *)inst->process_submodule->module->common;
+	if (app_process->bootstrap && (app_process->bootstrap(inst->process_submodule->data,
+							      inst->process_submodule->conf) < 0)) {
+		cf_log_err(conf, "Bootstrap failed for \"%s\"", app_process->name);
+		return -1;
+	}
 
-	while ((subcs = cf_section_find_next(server_cs, subcs, "process", NULL))) {
-		char const *name2;
+	/*
+	 *	No IO module, it's an empty listener.
+	 */
+	if (!inst->io_submodule) return 0;
 
-		name2 = cf_section_name2(subcs);
-		rcode = tacacs_compile_section(server_cs, "process", name2, MOD_AUTHENTICATE);
-		if (rcode < 0) return rcode;
+	/*
+	 *	Bootstrap the I/O module
+	 */
+	inst->app_io = (fr_app_io_t const *) inst->io_submodule->module->common;
+	inst->app_io_instance = inst->io_submodule->data;
+	inst->app_io_conf = inst->io_submodule->conf;
+	inst->app_io_private = dl_instance_symbol(dl_instance_find(inst->app_io_instance),
+						  "proto_tacacs_app_io_private");
+	rad_assert(inst->app_io_private);
+
+	if (inst->app_io->bootstrap && (inst->app_io->bootstrap(inst->app_io_instance,
+								inst->app_io_conf) < 0)) {
+		cf_log_err(inst->app_io_conf, "Bootstrap failed for \"%s\"", inst->app_io->name);
+		return -1;
 	}
 
 	return 0;
 }
 
-static int tacacs_load(void)
+static int mod_load(void)
 {
 	dict_tacacs_root = fr_dict_attr_child_by_num(fr_dict_root(fr_dict_internal), FR_TACACS_ROOT);
 	if (!dict_tacacs_root) {
 		ERROR("Missing TACACS-Root attribute");
 		return -1;
 	}
+
 	return 0;
 }
 
-extern rad_protocol_t proto_tacacs;
-rad_protocol_t proto_tacacs = {
-	.name		= "tacacs",
+fr_app_t proto_tacacs = {
 	.magic		= RLM_MODULE_INIT,
-	.load		= tacacs_load,
-	.inst_size	= sizeof(listen_socket_t),
-	.transports	= TRANSPORT_TCP,
-	.tls		= false,
-	.compile	= tacacs_listen_compile,
-	.parse		= common_socket_parse,
-	.open		= common_socket_open,
-	.recv		= tacacs_socket_recv,
-	.send		= NULL,
-	.error		= tacacs_socket_error,
-	.print		= common_socket_print,
-	.debug		= tacacs_packet_debug,
-	.encode		= NULL,
-	.decode		= NULL,
+	.name		= "tacacs",
+	.config		= proto_tacacs_config,
+	.inst_size	= sizeof(proto_tacacs_t),
+
+	.load		= mod_load,
+	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate,
+	.open		= mod_open,
+	.decode		= mod_decode,
+	.encode		= mod_encode,
+	.process_set	= mod_process_set
 };
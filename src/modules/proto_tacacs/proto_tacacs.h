@@ -0,0 +1,103 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _PROTO_TACACS_H
+#define _PROTO_TACACS_H
+
+#include "tacacs.h"
+
+/*
+ * $Id$
+ *
+ * @file proto_tacacs.h
+ * @brief Structures for the TACACS+ protocol
+ *
+ * @copyright 2017 The FreeRADIUS server project.
+ */
+
+/** A TACACS+ session, as seen by the worker
+ *
+ *  The packet_ctx of every proto_tacacs transport points to one of
+ *  these.  The transport owns it, and keeps it for as long as the
+ *  session continues.  While a request is being processed, only the
+ *  worker touches it.
+ *
+ *  Authentication can take several packets.  Instead of the global
+ *  session-state tree, the state is kept in the session, which is
+ *  found by the session ID on the connection.
+ */
+typedef struct {
+	uint32_t			session_id;			//!< In network byte order.
+	uint8_t				seq_no;				//!< Of the last packet from the client.
+
+	bool				more;				//!< Set by the worker when it expects the client
+									///< to continue the session.
+
+	TALLOC_CTX			*state_ctx;			//!< session-state, between packets.
+	VALUE_PAIR			*state;				//!< session-state VPs, between packets.
+} proto_tacacs_session_t;
+
+/** Get src/dst address from the #fr_app_io_t module
+ *
+ * @param[out] sockaddr		structure to populate.
+ * @param[in] instance		#fr_app_io_t instance.
+ * @param[in] packet_ctx	as allocated/returned by the #fr_app_io_t.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+typedef int (*proto_tacacs_addr_get_t)(fr_socket_addr_t *sockaddr,
+				       void const *instance, void const *packet_ctx);
+
+/** Semi-private functions exported by proto_tacacs #fr_app_io_t modules
+ *
+ * Should only be used by the proto_tacacs module, and submodules.
+ */
+typedef struct {
+	proto_tacacs_addr_get_t		src;				//!< Retrieve the src address of the packet.
+	proto_tacacs_addr_get_t		dst;				//!< Retrieve the dst address of the packet.
+} proto_tacacs_app_io_t;
+
+/** An instance of a proto_tacacs listen section
+ *
+ */
+typedef struct {
+	CONF_SECTION			*server_cs;			//!< server CS for this listener
+
+	dl_instance_t			*io_submodule;			//!< As provided by the transport_parse
+									///< callback.  Broken out into the
+									///< app_io_* fields below for convenience.
+
+	fr_app_io_t const		*app_io;			//!< Easy access to the app_io handle.
+	void				*app_io_instance;		//!< Easy access to the app_io instance.
+	CONF_SECTION			*app_io_conf;			//!< Easy access to the app_io's config section.
+	proto_tacacs_app_io_t		*app_io_private;		//!< Internal interface for proto_tacacs.
+
+	char const			**types;			//!< TACACS-Packet-Type values we accept.
+	dl_instance_t			*process_submodule;		//!< One process module handles all types.
+
+	fr_io_process_t			process;			//!< process entry point
+
+	uint32_t			default_message_size;		//!< for message ring buffer
+	uint32_t			num_messages;			//!< for message ring buffer
+
+	bool				code_allowed[TAC_PLUS_ACCT + 1];	//!< Lookup allowed
+									///< TACACS-Packet-Type values.
+
+	fr_listen_t const		*listen;			//!< The listener structure which describes
+									///< the I/O path.
+} proto_tacacs_t;
+
+#endif	/* _PROTO_TACACS_H */
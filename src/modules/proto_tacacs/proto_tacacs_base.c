@@ -0,0 +1,484 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_tacacs/proto_tacacs_base.c
+ * @brief TACACS+ processing.
+ *
+ * @copyright 2017 The FreeRADIUS server project.
+ * @copyright 2017 Network RADIUS SARL <info@networkradius.com>
+ */
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/protocol.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/tacacs.h>
+#include <freeradius-devel/rad_assert.h>
+#include "proto_tacacs.h"
+
+static void tacacs_packet_debug(REQUEST *request, RADIUS_PACKET *packet, bool received)
+{
+	if (!RDEBUG_ENABLED) return;
+
+	radlog_request(L_DBG, L_DBG_LVL_1, request, "%s %s Id %u from %pV:%u to %pV:%u length %zu",
+		       received ? "Received" : "Sending",
+		       tacacs_lookup_packet_code(request->packet),
+		       tacacs_session_id(request->packet),
+		       fr_box_ipaddr(packet->src_ipaddr), packet->src_port,
+		       fr_box_ipaddr(packet->dst_ipaddr), packet->dst_port,
+		       packet->data_len);
+
+	rdebug_pair_list(L_DBG_LVL_1, request, packet->vps, NULL);
+}
+
+static void tacacs_status(REQUEST * const request, rlm_rcode_t rcode)
+{
+	char const *k = "Unknown";
+	char const *v = "Unknown";
+
+	switch (tacacs_type(request->packet)) {
+	case TAC_PLUS_AUTHEN:
+		k = "TACACS-Authentication-Status";
+		switch (rcode) {
+		case RLM_MODULE_OK:
+			v = "Pass";
+			break;
+		case RLM_MODULE_FAIL:
+		case RLM_MODULE_REJECT:
+		case RLM_MODULE_USERLOCK:
+			v = "Fail";
+			break;
+		case RLM_MODULE_INVALID:
+			v = "Error";
+			break;
+		case RLM_MODULE_HANDLED:	/* unlang set status */
+			return;
+		default:
+noop:
+			WARN("ignoring request to add TACACS status with code %d", rcode);
+			return;
+		}
+		break;
+	case TAC_PLUS_AUTHOR:
+		k = "TACACS-Authorization-Status";
+		switch (rcode) {
+		case RLM_MODULE_OK:
+			v = "Pass-Repl";
+			break;
+		case RLM_MODULE_FAIL:
+		case RLM_MODULE_REJECT:
+		case RLM_MODULE_USERLOCK:
+			v = "Fail";
+			break;
+		case RLM_MODULE_INVALID:
+			v = "Error";
+			break;
+		default:
+			goto noop;
+		}
+		break;
+	case TAC_PLUS_ACCT:
+		k = "TACACS-Accounting-Status";
+		switch (rcode) {
+		case RLM_MODULE_OK:
+			v = "Success";
+			break;
+		case RLM_MODULE_FAIL:
+		case RLM_MODULE_REJECT:
+		case RLM_MODULE_USERLOCK:
+		case RLM_MODULE_INVALID:
+			v = "Error";
+			break;
+		default:
+			goto noop;
+		}
+		break;
+	}
+
+	fr_pair_make(request->reply, &request->reply->vps, k, v, T_OP_EQ);
+}
+
+/** Restore the session-state of an authentication session
+ *
+ *  The state was saved in the session by session_save() when the
+ *  previous reply was sent.
+ */
+static void session_restore(REQUEST *request, proto_tacacs_session_t *session)
+{
+	if (!session->state_ctx) return;
+
+	talloc_free(request->state_ctx);
+	request->state_ctx = session->state_ctx;
+	request->state = session->state;
+
+	session->state_ctx = NULL;
+	session->state = NULL;
+}
+
+/** Save the session-state of an authentication session, for the next packet
+ *
+ */
+static int session_save(REQUEST *request, proto_tacacs_session_t *session)
+{
+	TALLOC_CTX *state_ctx;
+
+	state_ctx = talloc_init("session-state");
+	if (!state_ctx) return -1;
+
+	session->state_ctx = request->state_ctx;
+	session->state = request->state;
+
+	request->state_ctx = state_ctx;
+	request->state = NULL;
+
+	return 0;
+}
+
+/** Decide whether the session continues after this reply
+ *
+ *  Authentication continues if the reply asks the client for more
+ *  data.  The transport keeps the session, and we keep the
+ *  session-state in it.  Everything else ends the session.
+ */
+static void session_continue(REQUEST *request, proto_tacacs_session_t *session)
+{
+	fr_dict_attr_t const	*da;
+	VALUE_PAIR		*vp;
+
+	session->more = false;
+
+	if (tacacs_type(request->packet) != TAC_PLUS_AUTHEN) return;
+
+	da = fr_dict_attr_child_by_num(dict_tacacs_root, FR_TACACS_AUTHENTICATION_STATUS);
+	rad_assert(da != NULL);
+
+	vp = fr_pair_find_by_da(request->reply->vps, da, TAG_ANY);
+	if (!vp) return;
+
+	switch ((tacacs_authen_reply_status_t)vp->vp_uint8) {
+	case TAC_PLUS_AUTHEN_STATUS_PASS:
+	case TAC_PLUS_AUTHEN_STATUS_FAIL:
+	case TAC_PLUS_AUTHEN_STATUS_RESTART:
+	case TAC_PLUS_AUTHEN_STATUS_ERROR:
+	case TAC_PLUS_AUTHEN_STATUS_FOLLOW:
+		return;
+
+	default:
+		break;
+	}
+
+	/*
+	 *	Authentication would continue, but the sequence
+	 *	number cannot.
+	 */
+	if (session->seq_no == 253) {
+		RWARN("Sequence number would wrap, restarting authentication");
+		fr_pair_list_free(&request->reply->vps);
+
+		vp = fr_pair_afrom_da(request->reply, da);
+		rad_assert(vp != NULL);
+		vp->vp_uint8 = (tacacs_authen_reply_status_t)TAC_PLUS_AUTHEN_STATUS_RESTART;
+		fr_pair_add(&request->reply->vps, vp);
+		return;
+	}
+
+	if (session_save(request, session) < 0) {
+		RERROR("Failed saving session-state");
+		return;
+	}
+
+	session->more = true;
+}
+
+static fr_io_final_t mod_process(REQUEST *request, UNUSED fr_io_action_t action)
+{
+	rlm_rcode_t		rcode;
+	CONF_SECTION		*unlang;
+	fr_dict_enum_t const	*dv = NULL;
+	VALUE_PAIR		*vp, *auth_type;
+	vp_cursor_t		cursor;
+	proto_tacacs_session_t	*session = request->async->packet_ctx;
+
+	VERIFY_REQUEST(request);
+
+	switch (request->request_state) {
+	case REQUEST_INIT:
+		tacacs_packet_debug(request, request->packet, true);
+
+		request->component = "tacacs";
+
+		unlang = cf_section_find(request->server_cs, "recv", tacacs_lookup_packet_code(request->packet));
+		if (!unlang) unlang = cf_section_find(request->server_cs, "recv", "*");
+		if (!unlang) {
+			REDEBUG("Failed to find 'recv' section");
+			goto setup_send;
+		}
+
+		/*
+		 *	Continue an authentication session.
+		 */
+		if ((tacacs_type(request->packet) == TAC_PLUS_AUTHEN) && (session->seq_no > 1)) {
+			session_restore(request, session);
+		}
+
+		RDEBUG("Running 'recv %s' from file %s", cf_section_name2(unlang), cf_filename(unlang));
+		unlang_push_section(request, unlang, RLM_MODULE_REJECT);
+
+		request->request_state = REQUEST_RECV;
+		/* FALL-THROUGH */
+
+	case REQUEST_RECV:
+		rcode = unlang_interpret_continue(request);
+
+		if (request->master_state == REQUEST_STOP_PROCESSING) return FR_IO_DONE;
+
+		if (rcode == RLM_MODULE_YIELD) return FR_IO_YIELD;
+
+		rad_assert(request->log.unlang_indent == 0);
+
+		switch (rcode) {
+		case RLM_MODULE_NOOP:
+		case RLM_MODULE_NOTFOUND:
+		case RLM_MODULE_OK:
+		case RLM_MODULE_UPDATED:
+			break;
+
+		case RLM_MODULE_HANDLED:
+			goto setup_send;
+
+		case RLM_MODULE_FAIL:
+		case RLM_MODULE_INVALID:
+		case RLM_MODULE_REJECT:
+		case RLM_MODULE_USERLOCK:
+		default:
+			tacacs_status(request, rcode);
+			goto setup_send;
+		}
+
+		/*
+		 *	Find Auth-Type, and complain if they have too many.
+		 */
+		fr_pair_cursor_init(&cursor, &request->control);
+		auth_type = NULL;
+		while ((vp = fr_pair_cursor_next_by_num(&cursor, 0, FR_AUTH_TYPE, TAG_ANY)) != NULL) {
+			if (!auth_type) {
+				auth_type = vp;
+				continue;
+			}
+
+			RWDEBUG("Ignoring extra Auth-Type = %s",
+				fr_dict_enum_alias_by_value(NULL, auth_type->da, &vp->data));
+		}
+
+		/*
+		 *	No Auth-Type, force it to reject.
+		 */
+		if (!auth_type) {
+			REDEBUG2("No Auth-Type available: rejecting the user.");
+			tacacs_status(request, RLM_MODULE_REJECT);
+			goto setup_send;
+		}
+
+		/*
+		 *	Handle hard-coded Accept and Reject.
+		 */
+		if (auth_type->vp_uint32 == FR_AUTH_TYPE_ACCEPT) {
+			RDEBUG2("Auth-Type = Accept, allowing user");
+			tacacs_status(request, RLM_MODULE_OK);
+			goto setup_send;
+		}
+
+		if (auth_type->vp_uint32 == FR_AUTH_TYPE_REJECT) {
+			RDEBUG2("Auth-Type = Reject, rejecting user");
+			tacacs_status(request, RLM_MODULE_REJECT);
+			goto setup_send;
+		}
+
+		/*
+		 *	Find the appropriate Auth-Type by name.
+		 */
+		vp = auth_type;
+		dv = fr_dict_enum_by_value(NULL, vp->da, &vp->data);
+		if (!dv) {
+			REDEBUG2("Unknown Auth-Type %d found: rejecting the user", vp->vp_uint32);
+			tacacs_status(request, RLM_MODULE_FAIL);
+			goto setup_send;
+		}
+
+		unlang = cf_section_find(request->server_cs, "authenticate", dv->alias);
+		if (!unlang) {
+			REDEBUG2("No 'authenticate %s' section found: rejecting the user", dv->alias);
+			tacacs_status(request, RLM_MODULE_FAIL);
+			goto setup_send;
+		}
+
+		RDEBUG("Running 'authenticate %s' from file %s", cf_section_name2(unlang), cf_filename(unlang));
+		unlang_push_section(request, unlang, RLM_MODULE_NOTFOUND);
+
+		request->request_state = REQUEST_PROCESS;
+		/* FALL-THROUGH */
+
+	case REQUEST_PROCESS:
+		rcode = unlang_interpret_continue(request);
+
+		if (request->master_state == REQUEST_STOP_PROCESSING) return FR_IO_DONE;
+
+		if (rcode == RLM_MODULE_YIELD) return FR_IO_YIELD;
+
+		rad_assert(request->log.unlang_indent == 0);
+
+		switch (rcode) {
+			/*
+			 *	An authentication module FAIL
+			 *	return code, or any return code that
+			 *	is not expected from authentication,
+			 *	is the same as an explicit REJECT!
+			 */
+		case RLM_MODULE_FAIL:
+		case RLM_MODULE_INVALID:
+		case RLM_MODULE_NOOP:
+		case RLM_MODULE_NOTFOUND:
+		case RLM_MODULE_REJECT:
+		case RLM_MODULE_UPDATED:
+		case RLM_MODULE_USERLOCK:
+		default:
+			RDEBUG2("Failed to authenticate the user");
+			tacacs_status(request, RLM_MODULE_FAIL);
+			goto setup_send;
+
+		case RLM_MODULE_OK:
+			tacacs_status(request, RLM_MODULE_OK);
+			break;
+
+		case RLM_MODULE_HANDLED:
+			goto setup_send;
+		}
+
+	setup_send:
+		unlang = cf_section_find(request->server_cs, "send", tacacs_lookup_packet_code(request->packet));
+		if (!unlang) unlang = cf_section_find(request->server_cs, "send", "*");
+		if (!unlang) goto send_reply;
+
+		RDEBUG("Running 'send %s' from file %s", cf_section_name2(unlang), cf_filename(unlang));
+		unlang_push_section(request, unlang, RLM_MODULE_NOOP);
+
+		request->request_state = REQUEST_SEND;
+		/* FALL-THROUGH */
+
+	case REQUEST_SEND:
+		rcode = unlang_interpret_continue(request);
+
+		if (request->master_state == REQUEST_STOP_PROCESSING) return FR_IO_DONE;
+
+		if (rcode == RLM_MODULE_YIELD) return FR_IO_YIELD;
+
+		rad_assert(request->log.unlang_indent == 0);
+
+	send_reply:
+		session_continue(request, session);
+
+		tacacs_packet_debug(request, request->reply, false);
+		break;
+
+	default:
+		return FR_IO_FAIL;
+	}
+
+	return FR_IO_REPLY;
+}
+
+static int mod_bootstrap(UNUSED void *instance, CONF_SECTION *listen_cs)
+{
+	CONF_SECTION		*server_cs;
+	fr_dict_attr_t const	*da;
+
+	rad_assert(listen_cs);
+
+	server_cs = cf_item_to_section(cf_parent(listen_cs));
+	rad_assert(strcmp(cf_section_name1(server_cs), "server") == 0);
+
+	da = fr_dict_attr_by_num(NULL, 0, FR_AUTH_TYPE);
+	if (!da) {
+		cf_log_err(server_cs, "Failed finding dictionary definition for Auth-Type");
+		return -1;
+	}
+
+	if (virtual_server_section_attribute_define(server_cs, "authenticate", da) < 0) return -1;
+
+	return 0;
+}
+
+/*
+ *	Ensure that the "recv foo" etc. sections are compiled.
+ */
+static int mod_instantiate(UNUSED void *instance, CONF_SECTION *listen_cs)
+{
+	int		rcode;
+	CONF_SECTION	*server_cs;
+	CONF_SECTION	*subcs = NULL;
+
+	rad_assert(listen_cs);
+
+	server_cs = cf_item_to_section(cf_parent(listen_cs));
+	rad_assert(strcmp(cf_section_name1(server_cs), "server") == 0);
+
+	rcode = unlang_compile_subsection(server_cs, "recv", "Authentication", MOD_AUTHORIZE);
+	if (rcode < 0) return rcode;
+
+	rcode = unlang_compile_subsection(server_cs, "send", "Authentication", MOD_POST_AUTH);
+	if (rcode < 0) return rcode;
+
+	rcode = unlang_compile_subsection(server_cs, "recv", "Authorization", MOD_AUTHORIZE);
+	if (rcode < 0) return rcode;
+
+	rcode = unlang_compile_subsection(server_cs, "send", "Authorization", MOD_POST_AUTH);
+	if (rcode < 0) return rcode;
+
+	rcode = unlang_compile_subsection(server_cs, "recv", "Accounting", MOD_PREACCT);
+	if (rcode < 0) return rcode;
+
+	rcode = unlang_compile_subsection(server_cs, "send", "Accounting", MOD_ACCOUNTING);
+	if (rcode < 0) return rcode;
+
+	while ((subcs = cf_section_find_next(server_cs, subcs, "authenticate", CF_IDENT_ANY))) {
+		char const	*name2;
+
+		name2 = cf_section_name2(subcs);
+		if (!name2) {
+			cf_log_err(subcs, "Invalid 'authenticate { ... }' section, it must have a name");
+			return -1;
+		}
+
+		rcode = unlang_compile_subsection(server_cs, "authenticate", name2, MOD_AUTHENTICATE);
+		if (rcode < 0) {
+			cf_log_err(subcs, "Failed compiling 'authenticate %s { ... }' section", name2);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+extern fr_app_process_t proto_tacacs_base;
+fr_app_process_t proto_tacacs_base = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "tacacs_base",
+	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate,
+	.process	= mod_process,
+};
@@ -0,0 +1,9 @@
+TARGETNAME	:= proto_tacacs_base
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME).a
+endif
+
+SOURCES		:= proto_tacacs_base.c
+
+TGT_PREREQS	:= libfreeradius-tacacs.a
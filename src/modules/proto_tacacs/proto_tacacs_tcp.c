@@ -0,0 +1,883 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_tacacs_tcp.c
+ * @brief TACACS+ handler for TCP.
+ *
+ * Each connection has its own table of sessions, keyed by the session
+ * ID.  A client which uses single-connect mode can run many sessions
+ * over one connection, and the sessions on different connections never
+ * collide.
+ *
+ * Packets are decrypted here, by the network thread, so that the
+ * workers only see clear text.  Every packet which is complete in the
+ * receive buffer is decrypted in one batch, with tacacs_xor_batch().
+ *
+ * @copyright 2017 The FreeRADIUS server project.
+ */
+#include <netdb.h>
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/protocol.h>
+#include <freeradius-devel/rbtree.h>
+#include <freeradius-devel/io/io.h>
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/rad_assert.h>
+#include "proto_tacacs.h"
+
+/*
+ *	The most data we queue for a connection which isn't reading
+ *	its replies, before giving up on it.
+ */
+#define TCP_MAX_QUEUED (64 * TACACS_MAX_PACKET_SIZE)
+
+/*
+ *	How much we read from a connection at once.  Enough for a
+ *	full sized packet, or for many small ones, so that they can be
+ *	decrypted together.
+ */
+#define TCP_RX_SIZE (4 * TACACS_MAX_PACKET_SIZE)
+
+/*
+ *	How many packets we decrypt at once.
+ */
+#define TCP_BATCH_MAX (64)
+
+typedef struct proto_tacacs_tcp_t proto_tacacs_tcp_t;
+
+/** A session on a connection
+ *
+ *  The public part is the packet_ctx which the worker sees.
+ */
+typedef struct {
+	proto_tacacs_session_t		session;		//!< Must be first.
+
+	proto_tacacs_tcp_t		*conn;			//!< The connection the session is on.
+
+	bool				busy;			//!< A worker is processing a packet from
+								//!< this session.
+
+	fr_time_t			timestamp;		//!< When the last packet was received, or
+								//!< when the session went idle.
+
+	fr_dlist_t			idle;			//!< Entry in the connection's idle list.
+} proto_tacacs_tcp_session_t;
+
+/** A listening socket, or a connection accepted on one
+ *
+ *  Connections start as a copy of the listening socket's instance.
+ */
+struct proto_tacacs_tcp_t {
+	proto_tacacs_t	const		*parent;		//!< The module that spawned us!
+
+	int				sockfd;
+
+	fr_ipaddr_t			ipaddr;			//!< Ipaddr to listen on.
+
+	bool				ipaddr_is_set;		//!< ipaddr config item is set.
+	bool				ipv4addr_is_set;	//!< ipv4addr config item is set.
+	bool				ipv6addr_is_set;	//!< ipv6addr config item is set.
+
+	char const			*interface;		//!< Interface to bind to.
+	char const			*port_name;		//!< Name of the port for getservent().
+
+	uint16_t			port;			//!< Port to listen on.
+
+	uint32_t			max_connections;	//!< Maximum number of connections on the
+								//!< listening socket.  0 means no limit.
+	uint32_t			num_connections;	//!< Number of connections open.
+
+	uint32_t			max_sessions;		//!< Maximum number of sessions on each
+								//!< connection.
+
+	proto_tacacs_tcp_t		*listener;		//!< The listening socket this connection was
+								//!< accepted on, or NULL if we're the listener.
+
+	fr_ipaddr_t			src_ipaddr;		//!< Address of the client.
+	uint16_t			src_port;
+	fr_ipaddr_t			dst_ipaddr;		//!< Our address.
+	uint16_t			dst_port;
+
+	RADCLIENT			*client;		//!< The client, found when the connection
+								//!< was accepted.
+
+	rbtree_t			*sessions;		//!< Sessions on the connection, by session ID.
+	fr_dlist_t			idle;			//!< Sessions waiting for the client to continue,
+								//!< oldest first.
+
+	uint8_t				*rx;			//!< Data we've read.
+	size_t				rx_used;		//!< How much data is in "rx".
+	size_t				rx_start;		//!< Start of the first packet we haven't
+								//!< returned.
+	size_t				rx_ready;		//!< End of the packets which have been
+								//!< decrypted, and checked.
+
+	uint8_t				*tx;			//!< Replies we haven't yet written.
+	size_t				tx_used;		//!< How much data is in "tx".
+};
+
+static const CONF_PARSER tcp_listen_config[] = {
+	{ FR_CONF_IS_SET_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, proto_tacacs_tcp_t, ipaddr) },
+	{ FR_CONF_IS_SET_OFFSET("ipv4addr", FR_TYPE_IPV4_ADDR, proto_tacacs_tcp_t, ipaddr) },
+	{ FR_CONF_IS_SET_OFFSET("ipv6addr", FR_TYPE_IPV6_ADDR, proto_tacacs_tcp_t, ipaddr) },
+
+	{ FR_CONF_OFFSET("interface", FR_TYPE_STRING, proto_tacacs_tcp_t, interface) },
+	{ FR_CONF_OFFSET("port_name", FR_TYPE_STRING, proto_tacacs_tcp_t, port_name) },
+
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, proto_tacacs_tcp_t, port), .dflt = "49" },
+
+	{ FR_CONF_OFFSET("max_connections", FR_TYPE_UINT32, proto_tacacs_tcp_t, max_connections), .dflt = "64" },
+	{ FR_CONF_OFFSET("max_sessions", FR_TYPE_UINT32, proto_tacacs_tcp_t, max_sessions), .dflt = "256" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+/** Return the src address associated with the packet_ctx
+ *
+ */
+static int mod_src_address(fr_socket_addr_t *src, UNUSED void const *instance, void const *packet_ctx)
+{
+	proto_tacacs_tcp_session_t const *session = packet_ctx;
+
+	memset(src, 0, sizeof(*src));
+
+	src->proto = IPPROTO_TCP;
+	memcpy(&src->ipaddr, &session->conn->src_ipaddr, sizeof(src->ipaddr));
+
+	return 0;
+}
+
+/** Return the dst address associated with the packet_ctx
+ *
+ */
+static int mod_dst_address(fr_socket_addr_t *dst, UNUSED void const *instance, void const *packet_ctx)
+{
+	proto_tacacs_tcp_session_t const *session = packet_ctx;
+
+	memset(dst, 0, sizeof(*dst));
+
+	dst->proto = IPPROTO_TCP;
+	memcpy(&dst->ipaddr, &session->conn->dst_ipaddr, sizeof(dst->ipaddr));
+
+	return 0;
+}
+
+/*
+ *	proto_tacacs passes us its own instance, so everything has to
+ *	come from the packet_ctx.
+ */
+static int mod_decode(UNUSED void const *instance, REQUEST *request, UNUSED uint8_t *const data, UNUSED size_t data_len)
+{
+	proto_tacacs_tcp_session_t const	*session = request->async->packet_ctx;
+	proto_tacacs_tcp_t const		*conn = session->conn;
+
+	request->client = conn->client;
+	request->packet->sockfd = conn->sockfd;
+	request->packet->proto = IPPROTO_TCP;
+	request->packet->src_ipaddr = conn->src_ipaddr;
+	request->packet->src_port = conn->src_port;
+	request->packet->dst_ipaddr = conn->dst_ipaddr;
+	request->packet->dst_port = conn->dst_port;
+
+	request->reply->sockfd = conn->sockfd;
+	request->reply->proto = IPPROTO_TCP;
+	request->reply->src_ipaddr = conn->dst_ipaddr;
+	request->reply->src_port = conn->dst_port;
+	request->reply->dst_ipaddr = conn->src_ipaddr;
+	request->reply->dst_port = conn->src_port;
+
+	request->root = &main_config;
+	VERIFY_REQUEST(request);
+
+	return 0;
+}
+
+/** NAK a packet
+ *
+ *  There's nothing to send.  mod_write() sees the empty reply, and
+ *  forgets the session.
+ */
+static size_t mod_nak(UNUSED void const *instance, UNUSED uint8_t *const packet, UNUSED size_t packet_len,
+		      UNUSED uint8_t *reply, UNUSED size_t reply_len)
+{
+	return 0;
+}
+
+static int session_cmp(void const *one, void const *two)
+{
+	proto_tacacs_tcp_session_t const *a = one;
+	proto_tacacs_tcp_session_t const *b = two;
+
+	return (a->session.session_id > b->session.session_id) - (a->session.session_id < b->session.session_id);
+}
+
+/** Free the session-state when the session goes away
+ *
+ *  The state context has no parent, as the worker takes it over when
+ *  the session continues.
+ */
+static int _session_free(proto_tacacs_tcp_session_t *session)
+{
+	fr_dlist_remove(&session->idle);
+
+	if (session->session.state_ctx) talloc_free(session->session.state_ctx);
+
+	return 0;
+}
+
+/** Forget a session
+ *
+ */
+static void session_delete(proto_tacacs_tcp_t *conn, proto_tacacs_tcp_session_t *session)
+{
+	(void) rbtree_deletebydata(conn->sessions, session);
+	talloc_free(session);
+}
+
+/** Forget sessions which the client hasn't continued
+ *
+ *  Sessions go onto the idle list when a reply is sent, so the
+ *  oldest is always first.
+ */
+static void session_expire(proto_tacacs_tcp_t *conn, fr_time_t now)
+{
+	fr_dlist_t *entry;
+	fr_time_t timeout = (fr_time_t) main_config.continuation_timeout * NANOSEC;
+
+	while ((entry = FR_DLIST_FIRST(conn->idle)) != NULL) {
+		proto_tacacs_tcp_session_t *session;
+
+		session = fr_ptr_to_type(proto_tacacs_tcp_session_t, idle, entry);
+		if ((session->timestamp + timeout) > now) break;
+
+		DEBUG2("Expiring idle session %08x from client %pV:%u",
+		       ntohl(session->session.session_id), fr_box_ipaddr(conn->src_ipaddr), conn->src_port);
+		session_delete(conn, session);
+	}
+}
+
+/** Find the session for a packet, or start a new one
+ *
+ * @return
+ *	- the session, which is now busy.
+ *	- NULL if the packet should be ignored.
+ */
+static proto_tacacs_tcp_session_t *session_find(proto_tacacs_tcp_t *conn, uint8_t const *packet, fr_time_t now)
+{
+	tacacs_packet_hdr_t const	*hdr = (tacacs_packet_hdr_t const *)packet;
+	proto_tacacs_tcp_session_t	my_session, *session;
+
+	my_session.session.session_id = hdr->session_id;
+
+	session = rbtree_finddata(conn->sessions, &my_session);
+	if (session) {
+		if (session->busy) {
+			DEBUG2("Ignoring packet for session %08x, which is still being processed",
+			       ntohl(hdr->session_id));
+			return NULL;
+		}
+
+		/*
+		 *	The client started again, with the same
+		 *	session ID.
+		 */
+		if (hdr->seq_no == 1) {
+			session_delete(conn, session);
+			goto alloc;
+		}
+
+		if (hdr->seq_no != (session->session.seq_no + 2)) {
+			DEBUG2("Ignoring packet for session %08x with sequence number %u, expected %u",
+			       ntohl(hdr->session_id), hdr->seq_no, session->session.seq_no + 2);
+			return NULL;
+		}
+
+		goto found;
+	}
+
+	if (hdr->seq_no != 1) {
+		DEBUG2("Ignoring packet for unknown session %08x", ntohl(hdr->session_id));
+		return NULL;
+	}
+
+alloc:
+	if (rbtree_num_elements(conn->sessions) >= conn->max_sessions) {
+		DEBUG2("Ignoring new session %08x from client %pV:%u due to max_sessions (%u)",
+		       ntohl(hdr->session_id), fr_box_ipaddr(conn->src_ipaddr), conn->src_port, conn->max_sessions);
+		return NULL;
+	}
+
+	session = talloc_zero(conn, proto_tacacs_tcp_session_t);
+	if (!session) return NULL;
+
+	session->session.session_id = hdr->session_id;
+	session->conn = conn;
+	session->idle.prev = session->idle.next = &session->idle;
+	talloc_set_destructor(session, _session_free);
+
+	if (!rbtree_insert(conn->sessions, session)) {
+		talloc_free(session);
+		return NULL;
+	}
+
+found:
+	fr_dlist_remove(&session->idle);
+
+	session->session.seq_no = hdr->seq_no;
+	session->session.more = false;
+	session->busy = true;
+	session->timestamp = now;
+
+	return session;
+}
+
+/** Write any queued data
+ *
+ * @param[in] instance of the TACACS+ TCP connection.
+ * @return
+ *	- 0 if everything was written.
+ *	- 1 if data is still queued, and we need to wait for the socket to become writable.
+ *	- <0 on error.
+ */
+static int mod_flush(void const *instance)
+{
+	proto_tacacs_tcp_t	*conn;
+	ssize_t			rcode;
+
+	memcpy(&conn, &instance, sizeof(conn)); /* const issues */
+
+	conn = talloc_get_type_abort(conn, proto_tacacs_tcp_t);
+
+	if (!conn->tx_used) return 0;
+
+	if (conn->sockfd < 0) {
+		conn->tx_used = 0;
+		return 0;
+	}
+
+	rcode = write(conn->sockfd, conn->tx, conn->tx_used);
+	if (rcode < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 1;
+
+		fr_strerror_printf("Failed writing to socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	conn->tx_used -= rcode;
+	if (conn->tx_used) {
+		memmove(conn->tx, conn->tx + rcode, conn->tx_used);
+		return 1;
+	}
+
+	return 0;
+}
+
+/** Add data to the end of the write queue
+ *
+ */
+static int mod_queue(proto_tacacs_tcp_t *conn, uint8_t const *data, size_t data_len)
+{
+	if ((conn->tx_used + data_len) > TCP_MAX_QUEUED) {
+		fr_strerror_printf("Too much data queued for client %pV:%u",
+				   fr_box_ipaddr(conn->src_ipaddr), conn->src_port);
+		return -1;
+	}
+
+	if ((conn->tx_used + data_len) > talloc_array_length(conn->tx)) {
+		uint8_t *tx;
+
+		tx = talloc_realloc(conn, conn->tx, uint8_t, conn->tx_used + data_len + TACACS_MAX_PACKET_SIZE);
+		if (!tx) {
+			fr_strerror_printf("Failed allocating memory");
+			return -1;
+		}
+		conn->tx = tx;
+	}
+
+	memcpy(conn->tx + conn->tx_used, data, data_len);
+	conn->tx_used += data_len;
+
+	return 0;
+}
+
+/** Decrypt and check every complete packet in the receive buffer
+ *
+ * @return
+ *	- <0 on error.  The connection should be closed.
+ *	- 0 if there are no complete packets.
+ *	- >0 the number of packets which are now ready.
+ */
+static int mod_decrypt(proto_tacacs_tcp_t *conn)
+{
+	tacacs_batch_t	batch[TCP_BATCH_MAX];
+	int		i, num = 0;
+
+	while ((num < TCP_BATCH_MAX) && ((conn->rx_ready + sizeof(tacacs_packet_hdr_t)) <= conn->rx_used)) {
+		tacacs_packet_hdr_t const	*hdr = (tacacs_packet_hdr_t const *)(conn->rx + conn->rx_ready);
+		size_t				packet_len;
+
+		packet_len = ntohl(hdr->length);
+		if (packet_len > (TACACS_MAX_PACKET_SIZE - sizeof(tacacs_packet_hdr_t))) {
+			fr_strerror_printf("Invalid packet length %zu from client %pV:%u", packet_len,
+					   fr_box_ipaddr(conn->src_ipaddr), conn->src_port);
+			return -1;
+		}
+		packet_len += sizeof(tacacs_packet_hdr_t);
+
+		if ((conn->rx_ready + packet_len) > conn->rx_used) break;
+
+		batch[num].packet = conn->rx + conn->rx_ready;
+		batch[num].packet_len = packet_len;
+		batch[num].secret = conn->client->secret;
+		num++;
+
+		conn->rx_ready += packet_len;
+	}
+
+	if (!num) return 0;
+
+	/*
+	 *	Packets which aren't TACACS+, or which we can't
+	 *	decrypt, close the connection, as we can no longer
+	 *	trust where the next packet starts.
+	 */
+	if (tacacs_xor_batch(batch, num) > 0) return -1;
+
+	for (i = 0; i < num; i++) {
+		if (!tacacs_ok(batch[i].packet, true)) return -1;
+	}
+
+	return num;
+}
+
+/** Read a packet from a connection
+ *
+ *  Packets may arrive in pieces, or many at once.  We read as much
+ *  as we can, decrypt all of the complete packets together, and then
+ *  return them one at a time.  When there's no more data, we return
+ *  0, and the network calls us again.
+ *
+ *  Packets which are ignored are skipped here, so that we only return
+ *  0 when there's nothing left to read.
+ */
+static ssize_t mod_read(void const *instance, void **packet_ctx, fr_time_t **recv_time, uint8_t *buffer, size_t buffer_len)
+{
+	proto_tacacs_tcp_t		*conn;
+	proto_tacacs_tcp_session_t	*session;
+	fr_time_t			now;
+
+	memcpy(&conn, &instance, sizeof(conn)); /* const issues */
+
+	conn = talloc_get_type_abort(conn, proto_tacacs_tcp_t);
+
+	rad_assert(conn->listener != NULL);
+
+	if (buffer_len < TACACS_MAX_PACKET_SIZE) {
+		fr_strerror_printf("Buffer is too small for a packet");
+		return -1;
+	}
+
+	now = fr_time();
+	session_expire(conn, now);
+
+	for (;;) {
+		ssize_t		data_size;
+		int		rcode;
+
+		/*
+		 *	Return the next packet we've decrypted.
+		 */
+		if (conn->rx_start < conn->rx_ready) {
+			uint8_t				*packet = conn->rx + conn->rx_start;
+			tacacs_packet_hdr_t const	*hdr = (tacacs_packet_hdr_t const *)packet;
+			size_t				packet_len;
+
+			packet_len = sizeof(tacacs_packet_hdr_t) + ntohl(hdr->length);
+			conn->rx_start += packet_len;
+
+			/*
+			 *	A packet type we don't have a "type"
+			 *	for is dropped, rather than closing
+			 *	the connection.
+			 */
+			if ((hdr->type > TAC_PLUS_ACCT) || !conn->parent->code_allowed[hdr->type]) continue;
+
+			session = session_find(conn, packet, now);
+			if (!session) continue;
+
+			memcpy(buffer, packet, packet_len);
+
+			*packet_ctx = session;
+			*recv_time = &session->timestamp;
+
+			return packet_len;
+		}
+
+		/*
+		 *	Decrypt any complete packets.
+		 */
+		rcode = mod_decrypt(conn);
+		if (rcode < 0) return -1;
+		if (rcode > 0) continue;
+
+		/*
+		 *	Make room for more data, and read it.
+		 */
+		if (conn->rx_start > 0) {
+			conn->rx_used -= conn->rx_start;
+			conn->rx_ready -= conn->rx_start;
+			memmove(conn->rx, conn->rx + conn->rx_start, conn->rx_used);
+			conn->rx_start = 0;
+		}
+
+		data_size = read(conn->sockfd, conn->rx + conn->rx_used, TCP_RX_SIZE - conn->rx_used);
+		if (data_size < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+			fr_strerror_printf("Failed reading from socket: %s", fr_syserror(errno));
+			return -1;
+		}
+
+		if (data_size == 0) {
+			fr_strerror_printf("Connection closed by client");
+			return -1;
+		}
+
+		conn->rx_used += data_size;
+	}
+}
+
+static ssize_t mod_write(void const *instance, void *packet_ctx,
+			 UNUSED fr_time_t request_time, uint8_t *buffer, size_t buffer_len)
+{
+	proto_tacacs_tcp_t		*conn;
+	proto_tacacs_tcp_session_t	*session = packet_ctx;
+
+	memcpy(&conn, &instance, sizeof(conn)); /* const issues */
+
+	conn = talloc_get_type_abort(conn, proto_tacacs_tcp_t);
+
+	rad_assert(session->conn == conn);
+
+	session->busy = false;
+
+	/*
+	 *	The session ends, unless the worker asked the client
+	 *	for more.  An empty reply is a NAK, or a packet we
+	 *	don't reply to, which also ends the session.
+	 */
+	if (!buffer_len || !session->session.more) {
+		session_delete(conn, session);
+	} else {
+		session->timestamp = fr_time();
+		fr_dlist_insert_tail(&conn->idle, &session->idle);
+	}
+
+	/*
+	 *	Only write replies if they're TACACS+ packets.
+	 *
+	 *	The replies are queued, to be written by mod_flush().
+	 */
+	if ((buffer_len >= sizeof(tacacs_packet_hdr_t)) && (conn->sockfd >= 0)) {
+		if (mod_queue(conn, buffer, buffer_len) < 0) return -1;
+	}
+
+	return buffer_len;
+}
+
+/** Open a TCP listener for TACACS+
+ *
+ * @param[in] instance of the TACACS+ TCP I/O path.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int mod_open(void *instance)
+{
+	proto_tacacs_tcp_t *inst = talloc_get_type_abort(instance, proto_tacacs_tcp_t);
+
+	int				sockfd = 0;
+	uint16_t			port = inst->port;
+
+	sockfd = fr_socket_server_tcp(&inst->ipaddr, &port, inst->port_name, true);
+	if (sockfd < 0) {
+		ERROR("Failed opening TCP socket: %s", fr_strerror());
+	error:
+		return -1;
+	}
+
+	if (fr_socket_bind(sockfd, &inst->ipaddr, &port, inst->interface) < 0) {
+		ERROR("Failed binding socket: %s", fr_strerror());
+	close_error:
+		close(sockfd);
+		goto error;
+	}
+
+	if (listen(sockfd, 8) < 0) {
+		ERROR("Failed listening on socket: %s", fr_syserror(errno));
+		goto close_error;
+	}
+
+	inst->sockfd = sockfd;
+
+	return 0;
+}
+
+/** Get the file descriptor for this socket.
+ *
+ * @param[in] instance of the TACACS+ TCP I/O path.
+ * @return the file descriptor
+ */
+static int mod_fd(void const *instance)
+{
+	proto_tacacs_tcp_t *inst = talloc_get_type_abort(instance, proto_tacacs_tcp_t);
+
+	return inst->sockfd;
+}
+
+/** Close a connection, or the listening socket
+ *
+ *  The sessions are kept until the connection is freed, as workers
+ *  may still be processing requests from them.
+ *
+ * @param[in] instance of the TACACS+ TCP I/O path.
+ * @return
+ *	- 0 on success.
+ */
+static int mod_close(void const *instance)
+{
+	proto_tacacs_tcp_t *inst;
+
+	memcpy(&inst, &instance, sizeof(inst)); /* const issues */
+
+	inst = talloc_get_type_abort(inst, proto_tacacs_tcp_t);
+
+	if (inst->sockfd < 0) return 0;
+
+	(void) mod_flush(inst);
+
+	close(inst->sockfd);
+	inst->sockfd = -1;
+
+	if (inst->listener) inst->listener->num_connections--;
+
+	return 0;
+}
+
+static int _connection_free(proto_tacacs_tcp_t *conn)
+{
+	(void) mod_close(conn);
+
+	return 0;
+}
+
+/** Accept a new connection
+ *
+ *  The client is checked here, rather than for every packet.
+ */
+static int mod_accept(void **connection, TALLOC_CTX *ctx, void const *instance)
+{
+	proto_tacacs_tcp_t		*inst, *conn;
+	int				newfd;
+	struct sockaddr_storage		src;
+	socklen_t			salen = sizeof(src);
+	RADCLIENT			*client;
+
+	memcpy(&inst, &instance, sizeof(inst)); /* const issues */
+
+	inst = talloc_get_type_abort(inst, proto_tacacs_tcp_t);
+
+	newfd = accept(inst->sockfd, (struct sockaddr *) &src, &salen);
+	if (newfd < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+		fr_strerror_printf("Failed accepting connection: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	conn = talloc_zero(ctx, proto_tacacs_tcp_t);
+	if (!conn) {
+		close(newfd);
+		fr_strerror_printf("Failed allocating memory");
+		return -1;
+	}
+
+	conn->parent = inst->parent;
+	conn->sockfd = newfd;
+	conn->listener = inst;
+	conn->port = inst->port;
+	conn->max_sessions = inst->max_sessions;
+	FR_DLIST_INIT(conn->idle);
+	talloc_set_destructor(conn, _connection_free);
+
+	inst->num_connections++;
+
+	if ((inst->max_connections != 0) && (inst->num_connections > inst->max_connections)) {
+		INFO("Ignoring new connection due to socket max_connections (%u)", inst->max_connections);
+	error:
+		talloc_free(conn);
+		return 0;
+	}
+
+	if (fr_nonblock(newfd) < 0) {
+		fr_strerror_printf("Failed setting socket to non-blocking: %s", fr_syserror(errno));
+		talloc_free(conn);
+		return -1;
+	}
+
+	if (fr_ipaddr_from_sockaddr(&src, salen, &conn->src_ipaddr, &conn->src_port) < 0) {
+		DEBUG2("Ignoring connection from unknown address family");
+		goto error;
+	}
+
+	salen = sizeof(src);
+	if ((getsockname(newfd, (struct sockaddr *) &src, &salen) < 0) ||
+	    (fr_ipaddr_from_sockaddr(&src, salen, &conn->dst_ipaddr, &conn->dst_port) < 0)) {
+		conn->dst_ipaddr = inst->ipaddr;
+		conn->dst_port = inst->port;
+	}
+
+	/*
+	 *	Lookup the client - Must exist to continue.
+	 */
+	client = client_find(NULL, &conn->src_ipaddr, IPPROTO_TCP);
+	if (!client) {
+		ERROR("Unknown client at address %pV:%u.  Ignoring...",
+		      fr_box_ipaddr(conn->src_ipaddr), conn->src_port);
+		goto error;
+	}
+	conn->client = client;
+
+	conn->sessions = rbtree_create(conn, session_cmp, NULL, RBTREE_FLAG_NONE);
+	conn->rx = talloc_array(conn, uint8_t, TCP_RX_SIZE);
+	if (!conn->sessions || !conn->rx) {
+		fr_strerror_printf("Failed allocating memory");
+		talloc_free(conn);
+		return -1;
+	}
+
+	DEBUG2("Accepted connection from client %pV:%u on socket %d",
+	       fr_box_ipaddr(conn->src_ipaddr), conn->src_port, newfd);
+
+	*connection = conn;
+	return 1;
+}
+
+static int mod_instantiate(void *instance, CONF_SECTION *cs)
+{
+	proto_tacacs_tcp_t	*inst = talloc_get_type_abort(instance, proto_tacacs_tcp_t);
+
+	inst->sockfd = -1;
+
+	/*
+	 *	Default to all IPv6 interfaces (it's the future)
+	 */
+	if (!inst->ipaddr_is_set && !inst->ipv4addr_is_set && !inst->ipv6addr_is_set) {
+		inst->ipaddr.af = AF_INET6;
+		inst->ipaddr.prefix = 128;
+		inst->ipaddr.addr.v6 = in6addr_any;	/* in6addr_any binds to all addresses */
+	}
+
+	if (!inst->port) {
+		struct servent *s;
+
+		if (!inst->port_name) {
+			cf_log_err(cs, "No 'port' specified in 'tcp' section");
+			return -1;
+		}
+
+		s = getservbyname(inst->port_name, "tcp");
+		if (!s) {
+			cf_log_err(cs, "Unknown value for 'port_name = %s", inst->port_name);
+			return -1;
+		}
+
+		inst->port = ntohl(s->s_port);
+	}
+
+	FR_INTEGER_BOUND_CHECK("max_connections", inst->max_connections, <=, 65535);
+
+	FR_INTEGER_BOUND_CHECK("max_sessions", inst->max_sessions, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_sessions", inst->max_sessions, <=, 65535);
+
+	return 0;
+}
+
+static int mod_bootstrap(void *instance, UNUSED CONF_SECTION *cs)
+{
+	proto_tacacs_tcp_t	*inst = talloc_get_type_abort(instance, proto_tacacs_tcp_t);
+	dl_instance_t const	*dl_inst;
+
+	/*
+	 *	Find the dl_instance_t holding our instance data
+	 *	so we can find out what the parent of our instance
+	 *	was.
+	 */
+	dl_inst = dl_instance_find(instance);
+	rad_assert(dl_inst);
+
+	inst->parent = talloc_get_type_abort(dl_inst->parent->data, proto_tacacs_t);
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	proto_tacacs_tcp_t	*inst = talloc_get_type_abort(instance, proto_tacacs_tcp_t);
+
+	if (inst->sockfd >= 0) close(inst->sockfd);
+	return 0;
+}
+
+
+/** Private interface for use by proto_tacacs
+ *
+ */
+extern proto_tacacs_app_io_t proto_tacacs_app_io_private;
+proto_tacacs_app_io_t proto_tacacs_app_io_private = {
+	.src			= mod_src_address,
+	.dst			= mod_dst_address
+};
+
+extern fr_app_io_t proto_tacacs_tcp;
+fr_app_io_t proto_tacacs_tcp = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "tacacs_tcp",
+	.config			= tcp_listen_config,
+	.inst_size		= sizeof(proto_tacacs_tcp_t),
+	.detach			= mod_detach,
+	.bootstrap		= mod_bootstrap,
+	.instantiate		= mod_instantiate,
+
+	.default_message_size	= TACACS_MAX_PACKET_SIZE,
+
+	/*
+	 *	Enough to return every packet in a full receive
+	 *	buffer of minimum sized packets.
+	 */
+	.max_reads		= 1024,
+	.open			= mod_open,
+	.accept			= mod_accept,
+	.close			= mod_close,
+	.read			= mod_read,
+	.decode			= mod_decode,
+	.write			= mod_write,
+	.nak			= mod_nak,
+	.flush			= mod_flush,
+	.fd			= mod_fd,
+};
@@ -69,9 +69,18 @@ uint32_t tacacs_session_id(RADIUS_PACKET const * const packet)
 	return vp->vp_uint32;
 }
 
-static bool tacacs_ok(RADIUS_PACKET const * const packet, bool from_client)
+/** Check that a decrypted packet is well-formed
+ *
+ * @param[in] packet		the raw packet.  The caller has already checked
+ *				that it's as long as its header says.
+ * @param[in] from_client	whether the packet was sent by a client.
+ * @return
+ *	- true if the packet is OK.
+ *	- false if it isn't.  The reason is in fr_strerror().
+ */
+bool tacacs_ok(uint8_t const *packet, bool from_client)
 {
-	tacacs_packet_t *pkt = (tacacs_packet_t *)packet->data;
+	tacacs_packet_t const *pkt = (tacacs_packet_t const *)packet;
 	size_t hdr_len, len;
 
 	if (pkt->hdr.ver.major != TAC_PLUS_MAJOR_VER || pkt->hdr.ver.minor & 0xe) {	/* minor == {0,1} */
@@ -181,58 +190,236 @@ bad_seqno:
 	return true;
 }
 
-static int tacacs_xor(RADIUS_PACKET * const packet, char const *secret)
+/*
+ *	Secrets longer than this are hashed one packet at a time by
+ *	tacacs_xor_batch().  The prefix of the pad hash is built on
+ *	the stack for each packet in a chunk.
+ */
+#define TACACS_BATCH_SECRET_MAX	(128)
+#define TACACS_BATCH_CHUNK	(32)
+#define TACACS_PAD_PREFIX_MAX	(sizeof(uint32_t) + TACACS_BATCH_SECRET_MAX + 2)
+
+/** XOR one block of the pad into the packet
+ *
+ *  A word at a time where we can.  memcpy() keeps it safe for
+ *  unaligned packets, and compiles to plain loads and stores.
+ */
+static inline void tacacs_pad_xor(uint8_t *p, uint8_t const *pad, size_t len)
 {
-	tacacs_packet_t *pkt = (tacacs_packet_t *)packet->data;
-	uint8_t pad[MD5_DIGEST_LENGTH];
-	uint8_t *buf;
-	int secret_len;
-	int pad_offset;
+	size_t i;
+
+	if (len == MD5_DIGEST_LENGTH) {
+		uint64_t a, b;
+
+		memcpy(&a, p, sizeof(a));
+		memcpy(&b, pad, sizeof(b));
+		a ^= b;
+		memcpy(p, &a, sizeof(a));
+
+		memcpy(&a, p + 8, sizeof(a));
+		memcpy(&b, pad + 8, sizeof(b));
+		a ^= b;
+		memcpy(p + 8, &a, sizeof(a));
+		return;
+	}
+
+	for (i = 0; i < len; i++) p[i] ^= pad[i];
+}
+
+/** Check the encryption flag of a packet against the secret
+ *
+ * @return
+ *	- 1 if the packet should be encrypted / decrypted.
+ *	- 0 if it's not encrypted, and there's no secret.
+ *	- -1 on error.
+ */
+static int tacacs_xor_check(uint8_t const *packet, size_t packet_len, char const *secret)
+{
+	tacacs_packet_hdr_t const *hdr = (tacacs_packet_hdr_t const *)packet;
+
+	if (packet_len < sizeof(tacacs_packet_hdr_t)) {
+		fr_strerror_printf("Packet is too short");
+		return -1;
+	}
 
 	if (!secret) {
-		if (pkt->hdr.flags & TAC_PLUS_UNENCRYPTED_FLAG)
-			return 0;
-		else {
-			fr_strerror_printf("Packet is encrypted but no secret for the client is set");
-			return -1;
-		}
+		if (hdr->flags & TAC_PLUS_UNENCRYPTED_FLAG) return 0;
+
+		fr_strerror_printf("Packet is encrypted but no secret for the client is set");
+		return -1;
 	}
 
-	if (pkt->hdr.flags & TAC_PLUS_UNENCRYPTED_FLAG) {
+	if (hdr->flags & TAC_PLUS_UNENCRYPTED_FLAG) {
 		fr_strerror_printf("Packet is unencrypted but a secret has been set for the client");
 		return -1;
 	}
 
-	secret_len = strlen(secret);
-	pad_offset = sizeof(pkt->hdr.session_id) + secret_len + sizeof(pkt->hdr.version) + sizeof(pkt->hdr.seq_no);
+	return 1;
+}
+
+/** Encrypt or decrypt the body of a packet
+ *
+ *  The pad is a chain of MD5 hashes:
+ *
+ *	MD5_1 = MD5{session_id, key, version, seq_no}
+ *	MD5_n = MD5{session_id, key, version, seq_no, MD5_n-1}
+ *
+ *  The hash of the prefix is calculated once, and copied for each
+ *  block of the pad.
+ *
+ * @param[in,out] packet	the raw packet, header included.
+ * @param[in] packet_len	length of the packet.
+ * @param[in] secret		shared secret, or NULL for none.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int tacacs_xor(uint8_t *packet, size_t packet_len, char const *secret)
+{
+	tacacs_packet_hdr_t	*hdr = (tacacs_packet_hdr_t *)packet;
+	uint8_t			pad[MD5_DIGEST_LENGTH];
+	FR_MD5_CTX		prefix, ctx;
+	uint8_t			*p, *end;
+	int			rcode;
+
+	rcode = tacacs_xor_check(packet, packet_len, secret);
+	if (rcode <= 0) return rcode;
 
-	/* MD5_1 = MD5{session_id, key, version, seq_no} */
-	/* MD5_n = MD5{session_id, key, version, seq_no, MD5_n-1} */
-	buf = talloc_array(NULL, uint8_t, pad_offset + MD5_DIGEST_LENGTH);
+	fr_md5_init(&prefix);
+	fr_md5_update(&prefix, (uint8_t const *)&hdr->session_id, sizeof(hdr->session_id));
+	fr_md5_update(&prefix, (uint8_t const *)secret, strlen(secret));
+	fr_md5_update(&prefix, &hdr->version, sizeof(hdr->version));
+	fr_md5_update(&prefix, &hdr->seq_no, sizeof(hdr->seq_no));
 
-	memcpy(&buf[0], &pkt->hdr.session_id, sizeof(pkt->hdr.session_id));
-	memcpy(&buf[sizeof(pkt->hdr.session_id)], secret, secret_len);
-	memcpy(&buf[sizeof(pkt->hdr.session_id) + secret_len], &pkt->hdr.version, sizeof(pkt->hdr.version));
-	memcpy(&buf[sizeof(pkt->hdr.session_id) + secret_len + sizeof(pkt->hdr.version)], &pkt->hdr.seq_no, sizeof(pkt->hdr.seq_no));
-	fr_md5_calc(pad, buf, pad_offset);
+	p = packet + sizeof(tacacs_packet_hdr_t);
+	end = packet + packet_len;
 
-	size_t pos = sizeof(tacacs_packet_hdr_t);
-	do {
-		for (size_t i = 0; i < MD5_DIGEST_LENGTH && pos < packet->data_len; i++, pos++)
-			packet->data[pos] ^= pad[i];
+	while (p < end) {
+		size_t len = end - p;
 
-		if (pos == packet->data_len)
-			break;
+		if (len > MD5_DIGEST_LENGTH) len = MD5_DIGEST_LENGTH;
 
-		memcpy(&buf[pad_offset], pad, MD5_DIGEST_LENGTH);
-		fr_md5_calc(pad, buf, pad_offset + MD5_DIGEST_LENGTH);
-	} while (1);
+		fr_md5_copy(&ctx, &prefix);
+		if (p > packet + sizeof(tacacs_packet_hdr_t)) fr_md5_update(&ctx, pad, sizeof(pad));
+		fr_md5_final(pad, &ctx);
 
-	talloc_free(buf);
+		tacacs_pad_xor(p, pad, len);
+		p += len;
+	}
 
 	return 0;
 }
 
+/** Encrypt or decrypt up to TACACS_BATCH_CHUNK packets
+ *
+ */
+static void tacacs_xor_chunk(tacacs_batch_t *batch, int num)
+{
+	int		i, r, hashed;
+	size_t		rounds = 0;
+	uint8_t		prefix[TACACS_BATCH_CHUNK][TACACS_PAD_PREFIX_MAX];
+	size_t		prefix_len[TACACS_BATCH_CHUNK];
+	size_t		blocks[TACACS_BATCH_CHUNK];
+	uint8_t		pad[2][TACACS_BATCH_CHUNK][MD5_DIGEST_LENGTH];
+	fr_md5_multi_t	msg[TACACS_BATCH_CHUNK];
+	int		idx[TACACS_BATCH_CHUNK];
+
+	for (i = 0; i < num; i++) {
+		tacacs_batch_t		*b = &batch[i];
+		tacacs_packet_hdr_t	*hdr = (tacacs_packet_hdr_t *)b->packet;
+		size_t			secret_len;
+		uint8_t			*p;
+
+		blocks[i] = 0;
+
+		b->rcode = tacacs_xor_check(b->packet, b->packet_len, b->secret);
+		if (b->rcode <= 0) continue;
+		b->rcode = 0;
+
+		secret_len = strlen(b->secret);
+		if (secret_len > TACACS_BATCH_SECRET_MAX) {
+			b->rcode = tacacs_xor(b->packet, b->packet_len, b->secret);
+			continue;
+		}
+
+		p = prefix[i];
+		memcpy(p, &hdr->session_id, sizeof(hdr->session_id));
+		p += sizeof(hdr->session_id);
+		memcpy(p, b->secret, secret_len);
+		p += secret_len;
+		*(p++) = hdr->version;
+		*(p++) = hdr->seq_no;
+		prefix_len[i] = p - prefix[i];
+
+		blocks[i] = (b->packet_len - sizeof(tacacs_packet_hdr_t) + MD5_DIGEST_LENGTH - 1) / MD5_DIGEST_LENGTH;
+		if (blocks[i] > rounds) rounds = blocks[i];
+	}
+
+	/*
+	 *	The blocks of one pad depend on each other, but the
+	 *	pads of different packets don't.  So each round
+	 *	calculates the next block of every pad which needs
+	 *	one, in parallel.  The pads alternate between two
+	 *	buffers, as each block is hashed from the one before.
+	 */
+	for (r = 0; (size_t) r < rounds; r++) {
+		uint8_t (*in)[MD5_DIGEST_LENGTH] = pad[(r + 1) & 0x01];
+		uint8_t (*out)[MD5_DIGEST_LENGTH] = pad[r & 0x01];
+
+		for (i = 0, hashed = 0; i < num; i++) {
+			if ((size_t) r >= blocks[i]) continue;
+
+			msg[hashed].ctx = NULL;
+			msg[hashed].in[0] = prefix[i];
+			msg[hashed].inlen[0] = prefix_len[i];
+			msg[hashed].in[1] = r ? in[i] : NULL;
+			msg[hashed].inlen[1] = r ? MD5_DIGEST_LENGTH : 0;
+			msg[hashed].out = out[i];
+			idx[hashed++] = i;
+		}
+
+		fr_md5_calc_multi(msg, hashed);
+
+		for (i = 0; i < hashed; i++) {
+			tacacs_batch_t	*b = &batch[idx[i]];
+			size_t		offset = sizeof(tacacs_packet_hdr_t) + (r * MD5_DIGEST_LENGTH);
+			size_t		len = b->packet_len - offset;
+
+			if (len > MD5_DIGEST_LENGTH) len = MD5_DIGEST_LENGTH;
+
+			tacacs_pad_xor(b->packet + offset, out[idx[i]], len);
+		}
+	}
+}
+
+/** Encrypt or decrypt a batch of packets
+ *
+ *  This gives the same results as calling tacacs_xor() for each
+ *  packet, but the pads for all of the packets are calculated
+ *  together with fr_md5_calc_multi().
+ *
+ * @param[in,out] batch	of packets.  The result for each packet is
+ *			written to its "rcode" field.
+ * @param[in] num	number of packets in the batch.
+ * @return the number of packets which failed.
+ */
+int tacacs_xor_batch(tacacs_batch_t *batch, int num)
+{
+	int i, failed = 0;
+
+	for (i = 0; i < num; i += TACACS_BATCH_CHUNK) {
+		int chunk = num - i;
+
+		if (chunk > TACACS_BATCH_CHUNK) chunk = TACACS_BATCH_CHUNK;
+
+		tacacs_xor_chunk(batch + i, chunk);
+	}
+
+	for (i = 0; i < num; i++) if (batch[i].rcode < 0) failed++;
+
+	return failed;
+}
+
 int tacacs_encode(RADIUS_PACKET * const packet, char const * const secret)
 {
 	uint8_t			*ptr;
@@ -459,7 +646,7 @@ int tacacs_decode(RADIUS_PACKET * const packet)
 	/*
 	 *	There MUST be at least a TACACS packert header, and
 	 *	packet->data_len == sizeof(pkt) + htonl(pkt->length),
-	 *	which is enforced in tacacs_read_packet().
+	 *	which is enforced by the transport.
 	 */
 	pkt = (tacacs_packet_t *)packet->data;
 
@@ -753,163 +940,18 @@ int tacacs_decode(RADIUS_PACKET * const packet)
 	return 0;
 }
 
-/*
- *	Receives a packet, assuming that the RADIUS_PACKET structure
- *	has been filled out already.
- *
- *	This ASSUMES that the packet is allocated && fields
- *	initialized.
+/** Add the header attributes of a reply
  *
- *	This ASSUMES that the socket is marked as O_NONBLOCK, which
- *	the function above does set, if your system supports it.
+ *  The version, type and session ID are copied from the request, and
+ *  the sequence number is one more than the request's.
  *
- *	Calling this function MAY change sockfd,
- *	if src_ipaddr.af == AF_UNSPEC.
+ * @param[in] packet	the reply.
+ * @param[in] original	the request.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
  */
-int tacacs_read_packet(RADIUS_PACKET * const packet, char const * const secret)
-{
-	ssize_t len;
-
-	/*
-	 *	No data allocated.  Read the 12-byte header into
-	 *	a temporary buffer.
-	 */
-	if (!packet->data) {
-		tacacs_packet_hdr_t *hdr;
-		size_t packet_len;
-
-		/* borrow vector to bring in the header for later talloc */
-		rad_assert(sizeof(tacacs_packet_hdr_t) <= AUTH_VECTOR_LEN);
-
-		/*
-		 *	Only read enough data to get the TACACS+ header.
-		 */
-		 len = recv(packet->sockfd, packet->vector + packet->data_len,
-			   sizeof(tacacs_packet_hdr_t) - packet->data_len, 0);
-		if (len == 0) return -2; /* clean close */
-
-#ifdef ECONNRESET
-		if ((len < 0) && (errno == ECONNRESET)) { /* forced */
-			return -2;
-		}
-#endif
-
-		if (len < 0) {
-			fr_strerror_printf("Error receiving packet: %s", fr_syserror(errno));
-			return -1;
-		}
-
-		packet->data_len += len;
-		if (packet->data_len < sizeof(tacacs_packet_hdr_t)) { /* want more data */
-			return 0;
-		}
-
-		rad_assert(packet->data_len == sizeof(tacacs_packet_hdr_t));
-
-		/*
-		 *	We now have the full packet header.  Let's go
-		 *	check it.
-		 */
-		hdr = (tacacs_packet_hdr_t *)packet->vector;
-
-		packet_len = ntohl(hdr->length);
-
-#ifdef __COVERITY__
-		if (!packet_len) {
-			fr_strerror_printf("Discarding packet: It contains no data");
-			return -1;
-		}
-#endif
-
-		if (packet_len + sizeof(tacacs_packet_hdr_t) > TACACS_MAX_PACKET_SIZE) {
-			fr_strerror_printf("Discarding packet: Larger than limitation of " STRINGIFY(MAX_PACKET_LEN) " bytes");
-			return -1;
-		}
-
-		packet_len += sizeof(tacacs_packet_hdr_t);
-
-		packet->data = talloc_array(packet, uint8_t, packet_len);
-		if (!packet->data) {
-			fr_strerror_printf("Out of memory");
-			return -1;
-		}
-
-		/*
-		 *	We have room for a full packet, but we've only
-		 *	read in the header so far.
-		 */
-		packet->data_len = packet_len;
-		packet->partial = sizeof(tacacs_packet_hdr_t);
-		memcpy(packet->data, packet->vector, sizeof(tacacs_packet_hdr_t));
-	}
-
-	/*
-	 *	Try to read more data.
-	 */
-	len = recv(packet->sockfd, packet->data + packet->partial,
-		   packet->data_len - packet->partial, 0);
-	if (len == 0) return -2; /* clean close */
-
-#ifdef ECONNRESET
-	if ((len < 0) && (errno == ECONNRESET)) { /* forced */
-		return -2;
-	}
-#endif
-
-	if (len < 0) {
-		fr_strerror_printf("Error receiving packet: %s", fr_syserror(errno));
-		return -1;
-	}
-
-	packet->partial += len;
-
-	if (packet->partial < packet->data_len) {
-		return 0;
-	}
-
-	if (tacacs_xor(packet, secret) < 0) {
-		fr_strerror_printf("Failed decryption of TACACS request: %s", fr_syserror(errno));
-		return -1;
-	}
-
-#ifndef NDEBUG
-	if ((fr_debug_lvl > 3) && fr_log_fp) fr_radius_print_hex(packet);
-#endif
-
-	/*
-	 *	See if it's a well-formed TACACS packet.
-	 */
-	if (!tacacs_ok(packet, true)) {
-		return -1;
-	}
-
-	/*
-	 *	Explicitly set the VP list to empty.
-	 */
-	packet->vps = NULL;
-
-	if (fr_debug_lvl) {
-		char ip_buf[INET6_ADDRSTRLEN], buffer[256];
-
-		if (packet->src_ipaddr.af != AF_UNSPEC) {
-			inet_ntop(packet->src_ipaddr.af,
-				  &packet->src_ipaddr.addr,
-				  ip_buf, sizeof(ip_buf));
-			snprintf(buffer, sizeof(buffer), "host %s port %d",
-				 ip_buf, packet->src_port);
-		} else {
-			snprintf(buffer, sizeof(buffer), "socket %d",
-				 packet->sockfd);
-		}
-
-	}
-
-	gettimeofday(&packet->timestamp, NULL);
-
-	return 1;	/* done reading the packet */
-}
-
-int tacacs_send(RADIUS_PACKET * const packet, RADIUS_PACKET const * const original, char const * const secret)
+int tacacs_reply_header(RADIUS_PACKET * const packet, RADIUS_PACKET const * const original)
 {
 	uint8_t			vminor;
 	tacacs_type_t		type;
@@ -928,6 +970,7 @@ int tacacs_send(RADIUS_PACKET * const packet, RADIUS_PACKET const * const origin
 	type = tacacs_type(original);
 
 	vp = fr_pair_afrom_child_num(packet, dict_tacacs_root, FR_TACACS_PACKET_TYPE);
+	if (!vp) return -1;
 	vp->vp_uint8 = type;
 	fr_pair_add(&packet->vps, vp);
 
@@ -945,24 +988,5 @@ int tacacs_send(RADIUS_PACKET * const packet, RADIUS_PACKET const * const origin
 	vp->vp_uint32 = tacacs_session_id(original);
 	fr_pair_add(&packet->vps, vp);
 
-	if (tacacs_encode(packet, secret) < 0) {
-		fr_strerror_printf("Failed encoding TACACS reply: %s", fr_syserror(errno));
-		return -1;
-	}
-
-#ifndef NDEBUG
-	if ((fr_debug_lvl > 3) && fr_log_fp) fr_radius_print_hex(packet);
-#endif
-
-	rad_assert(tacacs_ok(packet, false) == true);
-
-	if (tacacs_xor(packet, secret) < 0) {
-		fr_strerror_printf("Failed encryption of TACACS reply: %s", fr_syserror(errno));
-		return -1;
-	}
-
-	/*
-	 *	@fixme: EINTR and retry
-	 */
-	return write(packet->sockfd, packet->data, packet->data_len);
+	return 0;
 }
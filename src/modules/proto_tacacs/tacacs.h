@@ -233,13 +233,25 @@ typedef struct CC_HINT(__packed__) tacacs_packet {
 	};
 } tacacs_packet_t;
 
+/** A packet to be encrypted or decrypted by tacacs_xor_batch()
+ *
+ */
+typedef struct {
+	uint8_t			*packet;		//!< The raw TACACS+ packet, header included.
+	size_t			packet_len;		//!< Length of the packet.
+	char const		*secret;		//!< The shared secret, or NULL for none.
+	int			rcode;			//!< 0 on success, <0 on error.
+} tacacs_batch_t;
+
 tacacs_type_t tacacs_type(RADIUS_PACKET const * const packet);
 char const * tacacs_lookup_packet_code(RADIUS_PACKET const * const packet);
 uint32_t tacacs_session_id(RADIUS_PACKET const * const packet);
-int tacacs_read_packet(RADIUS_PACKET * const packet, char const * const secret);
+bool tacacs_ok(uint8_t const *packet, bool from_client);
+int tacacs_xor(uint8_t *packet, size_t packet_len, char const *secret);
+int tacacs_xor_batch(tacacs_batch_t *batch, int num);
 int tacacs_decode(RADIUS_PACKET * const packet);
 int tacacs_encode(RADIUS_PACKET * const packet, char const * const secret);
-int tacacs_send(RADIUS_PACKET * const packet, RADIUS_PACKET const * const original, char const * const secret);
+int tacacs_reply_header(RADIUS_PACKET * const packet, RADIUS_PACKET const * const original);
 
 extern fr_dict_attr_t const *dict_tacacs_root;
 
@@ -33,15 +33,28 @@ RCSID("$Id$")
 #include	<ctype.h>
 #include	<fcntl.h>
 
+/** An entry from the filter file, with its rules indexed by attribute
+ *
+ */
+typedef struct attr_filter_entry {
+	PAIR_LIST	*pl;				//!< Entry as read from the filter file.
+	VALUE_PAIR	**rules;			//!< All check items, sorted by da.
+	int		num_rules;			//!< Length of the rules array.
+	int		vsa_any;			//!< Number of "Vendor-Specific =* ANY" rules.
+} attr_filter_entry_t;
+
 /*
  *	Define a structure with the module configuration, so it can
  *	be used as the instance handle.
  */
 typedef struct rlm_attr_filter {
-	char const	*filename;
-	vp_tmpl_t	*key;
-	bool		relaxed;
-	PAIR_LIST	*attrs;
+	char const		*filename;
+	vp_tmpl_t		*key;
+	bool			relaxed;
+	PAIR_LIST		*attrs;
+
+	attr_filter_entry_t	*entries;		//!< One per entry in attrs, in the same order.
+	int			num_entries;
 } rlm_attr_filter_t;
 
 static const CONF_PARSER module_config[] = {
@@ -124,6 +137,72 @@ static int attr_filter_getfile(TALLOC_CTX *ctx, char const *filename, PAIR_LIST
 	return 0;
 }
 
+/*
+ *	Build the per-entry rule arrays, so each input attribute only
+ *	has to be compared against the rules for that attribute,
+ *	instead of against every rule in the entry.
+ */
+static int attr_filter_index(rlm_attr_filter_t *inst)
+{
+	PAIR_LIST		*pl;
+	attr_filter_entry_t	*entry;
+	VALUE_PAIR		*vp;
+
+	inst->num_entries = 0;
+	for (pl = inst->attrs; pl; pl = pl->next) inst->num_entries++;
+
+	inst->entries = talloc_zero_array(inst, attr_filter_entry_t, inst->num_entries);
+	if (!inst->entries) return -1;
+
+	for (pl = inst->attrs, entry = inst->entries; pl; pl = pl->next, entry++) {
+		int i, j;
+
+		entry->pl = pl;
+		for (vp = pl->check; vp; vp = vp->next) entry->num_rules++;
+
+		entry->rules = talloc_array(inst->entries, VALUE_PAIR *, entry->num_rules);
+		if (!entry->rules) return -1;
+
+		/*
+		 *	Insertion sort by da.  It's stable, so rules for the
+		 *	same attribute are still checked in file order.
+		 */
+		for (vp = pl->check, i = 0; vp; vp = vp->next, i++) {
+			if ((vp->da->attr == FR_VENDOR_SPECIFIC) && (vp->op == T_OP_CMP_TRUE)) entry->vsa_any++;
+
+			for (j = i; (j > 0) && ((uintptr_t)entry->rules[j - 1]->da > (uintptr_t)vp->da); j--) {
+				entry->rules[j] = entry->rules[j - 1];
+			}
+			entry->rules[j] = vp;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *	Return the index of the first rule for da, or num_rules if
+ *	there are none.
+ */
+static int attr_filter_rules_find(attr_filter_entry_t const *entry, fr_dict_attr_t const *da)
+{
+	int lo = 0, hi = entry->num_rules;
+
+	while (lo < hi) {
+		int mid = lo + ((hi - lo) / 2);
+
+		if ((uintptr_t)entry->rules[mid]->da < (uintptr_t)da) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if ((lo < entry->num_rules) && (entry->rules[lo]->da == da)) return lo;
+
+	return entry->num_rules;
+}
+
 
 /*
  *	(Re-)read the "attrs" file into memory.
@@ -140,6 +219,12 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (attr_filter_index(inst) < 0) {
+		ERROR("Failed indexing rules from %s", inst->filename);
+
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -155,7 +240,7 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void const *instance
 	vp_cursor_t	input, check, out;
 	VALUE_PAIR	*input_item, *check_item, *output;
 	PAIR_LIST	*pl;
-	int		found = 0;
+	int		found = 0, i, j;
 	int		pass, fail = 0;
 	char const	*keyname = NULL;
 	char		buffer[256];
@@ -179,9 +264,12 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void const *instance
 	/*
 	 *      Find the attr_filter profile entry for the entry.
 	 */
-	for (pl = inst->attrs; pl; pl = pl->next) {
-		int fall_through = 0;
-		int relax_filter = inst->relaxed;
+	for (i = 0; i < inst->num_entries; i++) {
+		attr_filter_entry_t const	*entry = &inst->entries[i];
+		int				fall_through = 0;
+		int				relax_filter = inst->relaxed;
+
+		pl = entry->pl;
 
 		/*
 		 *  If the current entry is NOT a default,
@@ -238,24 +326,15 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void const *instance
 			pass = fail = 0; /* reset the pass,fail vars for each reply item */
 
 			/*
-			 *  Reset the check_item pointer to beginning of the list
+			 *  Vendor-Specific is special, and matches any VSA if the
+			 *  comparison is always true.
 			 */
-			for (check_item = fr_pair_cursor_first(&check);
-			     check_item;
-			     check_item = fr_pair_cursor_next(&check)) {
-				/*
-				 *  Vendor-Specific is special, and matches any VSA if the
-				 *  comparison is always true.
-				 */
-				if ((check_item->da->attr == FR_VENDOR_SPECIFIC) && (input_item->da->vendor != 0) &&
-				    (check_item->op == T_OP_CMP_TRUE)) {
-					pass++;
-					continue;
-				}
+			if (input_item->da->vendor != 0) pass += entry->vsa_any;
 
-				if (input_item->da == check_item->da) {
-					check_pair(request, check_item, input_item, &pass, &fail);
-				}
+			for (j = attr_filter_rules_find(entry, input_item->da);
+			     (j < entry->num_rules) && (entry->rules[j]->da == input_item->da);
+			     j++) {
+				check_pair(request, entry->rules[j], input_item, &pass, &fail);
 			}
 
 			RDEBUG3("Attribute \"%s\" allowed by %i rules, disallowed by %i rules",
@@ -337,6 +416,7 @@ extern rad_module_t rlm_attr_filter;
 rad_module_t rlm_attr_filter = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "attr_filter",
+	.type		= RLM_TYPE_HUP_SAFE | RLM_TYPE_SHADOW_SAFE,
 	.inst_size	= sizeof(rlm_attr_filter_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
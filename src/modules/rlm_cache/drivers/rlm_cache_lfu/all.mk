@@ -0,0 +1,3 @@
+TARGET		:= rlm_cache_lfu.a
+SOURCES		:= rlm_cache_lfu.c
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,773 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_lfu.c
+ * @brief Memory bounded cache, which keeps the entries that are used most.
+ *
+ * Entries are kept in the style of W-TinyLFU.  New entries go into a small
+ * LRU "window".  When they fall out of it, they have to compete for a place
+ * in the main area with the entry that would be evicted to make room.
+ * Whichever key has been looked up more often wins.  Lookup frequencies are
+ * kept in a count-min sketch, which is aged by halving every counter after
+ * a fixed number of lookups.
+ *
+ * The main area is a segmented LRU.  Entries start in "probation", and are
+ * promoted to "protected" when they're used again.  Evictions come from
+ * probation first.
+ *
+ * A burst of one-off keys therefore only churns the window, and leaves the
+ * frequently used entries alone.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/io/time.h>
+#include "../../rlm_cache.h"
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+/** Number of independently locked caches entries are spread over
+ *
+ * Each gets an equal share of max_size.
+ */
+#define CACHE_LFU_STRIPES	(16)
+
+#define CACHE_LFU_SKETCH_DEPTH	(4)		//!< Counters per key in the frequency sketch.
+#define CACHE_LFU_SKETCH_MAX	(15)		//!< Largest value a counter can have.
+#define CACHE_LFU_ENTRY_SIZE	(512)		//!< Guess at the size of an entry, for sizing the sketch.
+#define CACHE_LFU_EVICT_MAX	(4)		//!< Most entries to evict on each insert, over the soft limit.
+
+typedef enum {
+	CACHE_LFU_WINDOW = 0,			//!< Recently added entries.
+	CACHE_LFU_PROBATION,			//!< Main area, not used since admission.
+	CACHE_LFU_PROTECTED,			//!< Main area, used since admission.
+	CACHE_LFU_SEGMENTS
+} rlm_cache_lfu_segment_t;
+
+typedef struct rlm_cache_lfu_entry {
+	rlm_cache_entry_t	fields;		//!< Entry data.
+
+	fr_dlist_t		list;		//!< Position in the LRU list of the segment.
+	rlm_cache_lfu_segment_t	segment;	//!< Segment the entry is in.
+	size_t			size;		//!< Memory used by the entry.
+	uint32_t		hash;		//!< Of the key.
+} rlm_cache_lfu_entry_t;
+
+typedef struct rlm_cache_lfu_stripe {
+	rbtree_t		*cache;		//!< Tree for looking up cache keys.
+
+	fr_dlist_t		lru[CACHE_LFU_SEGMENTS];	//!< Most recently used at the head.
+	size_t			used[CACHE_LFU_SEGMENTS];	//!< Memory used by each segment.
+
+	size_t			window_max;	//!< Memory available to the window.
+	size_t			main_max;	//!< Memory available to probation and protected.
+	size_t			protected_max;	//!< Memory available to protected.
+
+	uint8_t			*sketch;	//!< Lookup frequencies, CACHE_LFU_SKETCH_DEPTH rows.
+	uint32_t		sketch_mask;	//!< Width of a row, less one.
+	uint32_t		samples;	//!< Lookups recorded since the sketch was last aged.
+	uint32_t		samples_max;	//!< When to age the sketch.
+
+	pthread_mutex_t		mutex;		//!< Protect the stripe from multiple readers/writers.
+	bool			mutex_init;	//!< Whether the mutex needs to be destroyed.
+} rlm_cache_lfu_stripe_t;
+
+typedef struct rlm_cache_lfu {
+	size_t			max_size;	//!< Maximum memory used by all entries.
+
+	rlm_cache_lfu_stripe_t	stripe[CACHE_LFU_STRIPES];
+
+	atomic_uint_fast32_t	count;		//!< Number of entries in all stripes.
+	atomic_uint_fast64_t	memory;		//!< Memory used by entries in all stripes.
+	atomic_uint_fast64_t	hits;
+	atomic_uint_fast64_t	misses;
+	atomic_uint_fast64_t	evictions;
+	atomic_uint_fast64_t	rejected;
+
+	fr_memory_t		*module_memory;	//!< Memory of the module, and its limits.
+} rlm_cache_lfu_t;
+
+/** The stripe a request is using
+ *
+ * rlm_cache acquires a handle before it knows which entry it will
+ * touch, so the stripe is only locked on the first operation.
+ */
+typedef struct rlm_cache_lfu_handle {
+	REQUEST			*request;	//!< For sanity checks.
+	rlm_cache_lfu_stripe_t	*locked;	//!< Stripe we hold the mutex for, if any.
+} rlm_cache_lfu_handle_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("max_size", FR_TYPE_SIZE, rlm_cache_lfu_t, max_size), .dflt = "16777216" },
+	CONF_PARSER_TERMINATOR
+};
+
+/** Compare two entries by key
+ *
+ * There may only be one entry with the same key.
+ */
+static int cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+/** Walk over the cache rbtree
+ *
+ * Used to free any entries left in the tree on detach.
+ *
+ * @param ctx unused.
+ * @param data to free.
+ * @return 2
+ */
+static int _cache_entry_free(UNUSED void *ctx, void *data)
+{
+	talloc_free(data);
+
+	return 2;
+}
+
+/** Cleanup a cache_lfu instance
+ *
+ */
+static int mod_detach(void *instance)
+{
+	rlm_cache_lfu_t *driver = talloc_get_type_abort(instance, rlm_cache_lfu_t);
+	int i;
+
+	for (i = 0; i < CACHE_LFU_STRIPES; i++) {
+		rlm_cache_lfu_stripe_t *stripe = &driver->stripe[i];
+
+		if (stripe->cache) {
+			rbtree_walk(stripe->cache, RBTREE_DELETE_ORDER, _cache_entry_free, NULL);
+			talloc_free(stripe->cache);
+		}
+		talloc_free(stripe->sketch);
+
+		if (stripe->mutex_init) pthread_mutex_destroy(&stripe->mutex);
+	}
+
+	return 0;
+}
+
+/** Create a new cache_lfu instance
+ *
+ * @copydetails cache_instantiate_t
+ */
+static int mod_instantiate(rlm_cache_config_t const *config, void *instance, CONF_SECTION *conf)
+{
+	rlm_cache_lfu_t *driver = talloc_get_type_abort(instance, rlm_cache_lfu_t);
+	size_t		stripe_max;
+	uint32_t	width;
+	int		i, j;
+
+	stripe_max = driver->max_size / CACHE_LFU_STRIPES;
+	if (stripe_max < 1024) {
+		cf_log_err(conf, "max_size must be at least %u bytes", 1024 * CACHE_LFU_STRIPES);
+		return -1;
+	}
+
+	/*
+	 *	Enough counters for the number of entries we
+	 *	expect to fit, each row a power of two wide.
+	 */
+	for (width = 256; (width < (1 << 20)) && (width < (stripe_max / CACHE_LFU_ENTRY_SIZE)); width <<= 1);
+
+	atomic_init(&driver->count, 0);
+	atomic_init(&driver->memory, 0);
+	atomic_init(&driver->hits, 0);
+	atomic_init(&driver->misses, 0);
+	atomic_init(&driver->evictions, 0);
+	atomic_init(&driver->rejected, 0);
+	driver->module_memory = config->memory;
+
+	for (i = 0; i < CACHE_LFU_STRIPES; i++) {
+		rlm_cache_lfu_stripe_t *stripe = &driver->stripe[i];
+
+		/*
+		 *	The cache.
+		 */
+		stripe->cache = rbtree_create(NULL, cache_entry_cmp, NULL, 0);
+		if (!stripe->cache) {
+			ERROR("Failed to create cache");
+			return -1;
+		}
+
+		for (j = 0; j < CACHE_LFU_SEGMENTS; j++) FR_DLIST_INIT(stripe->lru[j]);
+
+		/*
+		 *	1% for the window, and 80% of the rest for
+		 *	entries which have proven themselves.
+		 */
+		stripe->window_max = stripe_max / 100;
+		if (stripe->window_max < CACHE_LFU_ENTRY_SIZE) stripe->window_max = CACHE_LFU_ENTRY_SIZE;
+		stripe->main_max = stripe_max - stripe->window_max;
+		stripe->protected_max = (stripe->main_max / 10) * 8;
+
+		stripe->sketch = talloc_zero_array(NULL, uint8_t, width * CACHE_LFU_SKETCH_DEPTH);
+		if (!stripe->sketch) {
+			ERROR("Failed to create frequency sketch");
+			return -1;
+		}
+		stripe->sketch_mask = width - 1;
+		stripe->samples_max = width * 10;
+
+		if (pthread_mutex_init(&stripe->mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			return -1;
+		}
+		stripe->mutex_init = true;
+	}
+
+	return 0;
+}
+
+/** Get the counter for one row of the sketch
+ *
+ * Uses double hashing, so only one hash of the key is needed.
+ */
+static inline uint8_t *sketch_counter(rlm_cache_lfu_stripe_t *stripe, uint32_t hash, int row)
+{
+	uint32_t step = ((hash >> 17) | (hash << 15)) | 1;
+
+	return &stripe->sketch[(row * (stripe->sketch_mask + 1)) + ((hash + (row * step)) & stripe->sketch_mask)];
+}
+
+/** Estimate how often a key has been looked up
+ *
+ */
+static uint8_t sketch_frequency(rlm_cache_lfu_stripe_t *stripe, uint32_t hash)
+{
+	uint8_t freq = CACHE_LFU_SKETCH_MAX;
+	int i;
+
+	for (i = 0; i < CACHE_LFU_SKETCH_DEPTH; i++) {
+		uint8_t *counter = sketch_counter(stripe, hash, i);
+
+		if (*counter < freq) freq = *counter;
+	}
+
+	return freq;
+}
+
+/** Record a lookup of a key
+ *
+ * Only the smallest counters are incremented, which keeps keys sharing
+ * counters from inflating each other's estimates.  Every samples_max
+ * lookups all counters are halved, so old popularity fades.
+ */
+static void sketch_increment(rlm_cache_lfu_stripe_t *stripe, uint32_t hash)
+{
+	uint8_t freq = sketch_frequency(stripe, hash);
+	uint32_t i;
+
+	if (freq < CACHE_LFU_SKETCH_MAX) for (i = 0; i < CACHE_LFU_SKETCH_DEPTH; i++) {
+		uint8_t *counter = sketch_counter(stripe, hash, i);
+
+		if (*counter == freq) (*counter)++;
+	}
+
+	if (++stripe->samples < stripe->samples_max) return;
+
+	for (i = 0; i < ((stripe->sketch_mask + 1) * CACHE_LFU_SKETCH_DEPTH); i++) stripe->sketch[i] >>= 1;
+	stripe->samples /= 2;
+}
+
+static inline rlm_cache_lfu_entry_t *lfu_tail(rlm_cache_lfu_stripe_t *stripe, rlm_cache_lfu_segment_t segment)
+{
+	fr_dlist_t *tail = FR_DLIST_TAIL(stripe->lru[segment]);
+
+	if (!tail) return NULL;
+
+	return fr_ptr_to_type(rlm_cache_lfu_entry_t, list, tail);
+}
+
+static inline void lfu_link(rlm_cache_lfu_stripe_t *stripe, rlm_cache_lfu_entry_t *e, rlm_cache_lfu_segment_t segment)
+{
+	e->segment = segment;
+	fr_dlist_insert_head(&stripe->lru[segment], &e->list);
+	stripe->used[segment] += e->size;
+}
+
+static inline void lfu_unlink(rlm_cache_lfu_stripe_t *stripe, rlm_cache_lfu_entry_t *e)
+{
+	fr_dlist_remove(&e->list);
+	stripe->used[e->segment] -= e->size;
+}
+
+/** Remove an entry from its stripe, and free it
+ *
+ */
+static void lfu_remove(rlm_cache_lfu_t *driver, rlm_cache_lfu_stripe_t *stripe, rlm_cache_lfu_entry_t *e)
+{
+	lfu_unlink(stripe, e);
+	rbtree_deletebydata(stripe->cache, e);
+
+	atomic_fetch_sub_explicit(&driver->count, 1, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&driver->memory, e->size, memory_order_relaxed);
+	if (driver->module_memory) fr_memory_add(driver->module_memory, -(int64_t) e->size);
+
+	talloc_free(e);
+}
+
+/** Move entries which have fallen out of the window into the main area
+ *
+ * If the main area is full, the candidate only gets in if its key has
+ * been looked up more often than the entry which would be evicted.
+ */
+static void lfu_admit(rlm_cache_lfu_t *driver, rlm_cache_lfu_stripe_t *stripe)
+{
+	rlm_cache_lfu_entry_t *candidate, *victim;
+
+	while ((stripe->used[CACHE_LFU_WINDOW] > stripe->window_max) &&
+	       (candidate = lfu_tail(stripe, CACHE_LFU_WINDOW))) {
+		while ((stripe->used[CACHE_LFU_PROBATION] + stripe->used[CACHE_LFU_PROTECTED] + candidate->size) >
+		       stripe->main_max) {
+			victim = lfu_tail(stripe, CACHE_LFU_PROBATION);
+			if (!victim) victim = lfu_tail(stripe, CACHE_LFU_PROTECTED);
+
+			if (!victim ||
+			    (sketch_frequency(stripe, candidate->hash) <= sketch_frequency(stripe, victim->hash))) {
+				lfu_remove(driver, stripe, candidate);
+				atomic_fetch_add_explicit(&driver->rejected, 1, memory_order_relaxed);
+				candidate = NULL;
+				break;
+			}
+
+			lfu_remove(driver, stripe, victim);
+			atomic_fetch_add_explicit(&driver->evictions, 1, memory_order_relaxed);
+		}
+
+		if (!candidate) continue;
+
+		lfu_unlink(stripe, candidate);
+		lfu_link(stripe, candidate, CACHE_LFU_PROBATION);
+	}
+}
+
+/** Update the position of an entry which was used
+ *
+ */
+static void lfu_touch(rlm_cache_lfu_stripe_t *stripe, rlm_cache_lfu_entry_t *e)
+{
+	rlm_cache_lfu_entry_t *demote;
+
+	switch (e->segment) {
+	case CACHE_LFU_WINDOW:
+	case CACHE_LFU_PROTECTED:
+		lfu_unlink(stripe, e);
+		lfu_link(stripe, e, e->segment);
+		return;
+
+	case CACHE_LFU_PROBATION:
+		lfu_unlink(stripe, e);
+		lfu_link(stripe, e, CACHE_LFU_PROTECTED);
+
+		/*
+		 *	Make room by demoting the least recently
+		 *	used protected entries.
+		 */
+		while ((stripe->used[CACHE_LFU_PROTECTED] > stripe->protected_max) &&
+		       (demote = lfu_tail(stripe, CACHE_LFU_PROTECTED)) && (demote != e)) {
+			lfu_unlink(stripe, demote);
+			lfu_link(stripe, demote, CACHE_LFU_PROBATION);
+		}
+		return;
+
+	default:
+		rad_assert(0);
+		return;
+	}
+}
+
+/** Lock the stripe a key lives in
+ *
+ * rlm_cache only works with one key between acquiring and releasing
+ * a handle, so a request holds at most one stripe.
+ */
+static rlm_cache_lfu_stripe_t *cache_stripe_lock(rlm_cache_lfu_t *driver, REQUEST *request,
+						 rlm_cache_lfu_handle_t *handle, uint32_t hash)
+{
+	rlm_cache_lfu_stripe_t *stripe;
+
+	stripe = &driver->stripe[hash % CACHE_LFU_STRIPES];
+	if (handle->locked == stripe) return stripe;
+
+	if (handle->locked) {
+		pthread_mutex_unlock(&handle->locked->mutex);
+		RDEBUG3("Mutex released");
+	}
+
+	pthread_mutex_lock(&stripe->mutex);
+	handle->locked = stripe;
+
+	RDEBUG3("Mutex acquired");
+
+	return stripe;
+}
+
+/** Custom allocation function for the driver
+ *
+ * Allows allocation of cache entry structures with additional fields.
+ *
+ * @copydetails cache_entry_alloc_t
+ */
+static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					    REQUEST *request)
+{
+	rlm_cache_lfu_entry_t *c;
+
+	c = talloc_zero(NULL, rlm_cache_lfu_entry_t);
+	if (!c) {
+		RERROR("Failed allocating cache entry");
+		return NULL;
+	}
+
+	return (rlm_cache_entry_t *)c;
+}
+
+/** Locate a cache entry
+ *
+ * Every lookup counts towards the frequency of the key, whether
+ * or not an entry is found.
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, void *instance,
+				       REQUEST *request, void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_lfu_t *driver = talloc_get_type_abort(instance, rlm_cache_lfu_t);
+	rlm_cache_lfu_stripe_t *stripe;
+	rlm_cache_lfu_entry_t *e;
+	rlm_cache_entry_t my_c;
+	uint32_t hash;
+
+	hash = fr_hash(key, key_len);
+	stripe = cache_stripe_lock(driver, request, handle, hash);
+
+	sketch_increment(stripe, hash);
+
+	my_c.key = key;
+	my_c.key_len = key_len;
+	e = rbtree_finddata(stripe->cache, &my_c);
+	if (e && (e->fields.expires < request->packet->timestamp.tv_sec)) {
+		lfu_remove(driver, stripe, e);
+		e = NULL;
+	}
+
+	if (!e) {
+		atomic_fetch_add_explicit(&driver->misses, 1, memory_order_relaxed);
+		*out = NULL;
+		return CACHE_MISS;
+	}
+
+	atomic_fetch_add_explicit(&driver->hits, 1, memory_order_relaxed);
+	lfu_touch(stripe, e);
+	*out = &e->fields;
+
+	return CACHE_OK;
+}
+
+/** Free an entry and remove it from the data store
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, void *handle,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_lfu_t *driver = talloc_get_type_abort(instance, rlm_cache_lfu_t);
+	rlm_cache_lfu_stripe_t *stripe;
+	rlm_cache_lfu_entry_t *e;
+	rlm_cache_entry_t my_c;
+
+	if (!request) return CACHE_ERROR;
+
+	stripe = cache_stripe_lock(driver, request, handle, fr_hash(key, key_len));
+
+	my_c.key = key;
+	my_c.key_len = key_len;
+	e = rbtree_finddata(stripe->cache, &my_c);
+	if (!e) return CACHE_MISS;
+
+	lfu_remove(driver, stripe, e);
+
+	return CACHE_OK;
+}
+
+/** Insert a new entry into the data store
+ *
+ * The entry goes into the window.  It may be rejected straight away
+ * if it is too large, or later when it has to compete for a place in
+ * the main area.  Either way rlm_cache sees a successful insert, as
+ * it would for any cache which evicts entries.
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, void *handle,
+					 rlm_cache_entry_t const *c)
+{
+	rlm_cache_lfu_t *driver = talloc_get_type_abort(instance, rlm_cache_lfu_t);
+	rlm_cache_lfu_stripe_t *stripe;
+	rlm_cache_lfu_entry_t *e;
+
+	if (!request) return CACHE_ERROR;
+
+	rad_assert(((rlm_cache_lfu_handle_t *)handle)->request == request);
+
+	memcpy(&e, &c, sizeof(e));
+
+	e->hash = fr_hash(c->key, c->key_len);
+	e->size = talloc_total_size(e);
+
+	stripe = cache_stripe_lock(driver, request, handle, e->hash);
+
+	if (e->size > stripe->main_max) {
+		RWDEBUG("Entry is larger than the cache, not storing it");
+	reject:
+		atomic_fetch_add_explicit(&driver->rejected, 1, memory_order_relaxed);
+		talloc_free(e);
+
+		return CACHE_OK;
+	}
+
+	if (driver->module_memory) {
+		int i;
+
+		/*
+		 *	Over the soft limit, evict the entries in this
+		 *	stripe which are least likely to be used again.
+		 */
+		for (i = 0; (i < CACHE_LFU_EVICT_MAX) &&
+			    (fr_memory_limit(driver->module_memory) != FR_MEMORY_OK); i++) {
+			rlm_cache_lfu_entry_t *victim;
+
+			victim = lfu_tail(stripe, CACHE_LFU_PROBATION);
+			if (!victim) victim = lfu_tail(stripe, CACHE_LFU_WINDOW);
+			if (!victim) victim = lfu_tail(stripe, CACHE_LFU_PROTECTED);
+			if (!victim) break;
+
+			lfu_remove(driver, stripe, victim);
+			atomic_fetch_add_explicit(&driver->evictions, 1, memory_order_relaxed);
+		}
+
+		if (!fr_memory_reserve(driver->module_memory, e->size)) {
+			RWDEBUG("Module memory is over its hard limit, not storing entry");
+			goto reject;
+		}
+	}
+
+	/*
+	 *	Allow overwriting
+	 */
+	if (!rbtree_insert(stripe->cache, e)) {
+		if (cache_entry_expire(config, instance, request, handle, c->key, c->key_len) != CACHE_OK) {
+			rad_assert(0);
+			if (driver->module_memory) fr_memory_add(driver->module_memory, -(int64_t) e->size);
+			return CACHE_ERROR;
+		}
+
+		if (!rbtree_insert(stripe->cache, e)) {
+			RERROR("Failed adding entry");
+			if (driver->module_memory) fr_memory_add(driver->module_memory, -(int64_t) e->size);
+
+			return CACHE_ERROR;
+		}
+	}
+
+	lfu_link(stripe, e, CACHE_LFU_WINDOW);
+
+	atomic_fetch_add_explicit(&driver->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&driver->memory, e->size, memory_order_relaxed);
+
+	lfu_admit(driver, stripe);
+
+	return CACHE_OK;
+}
+
+/** Update the TTL of an entry
+ *
+ * rlm_cache has already written the new expiry time, and entries
+ * aren't ordered by it, so there's nothing else to do.
+ *
+ * @copydetails cache_entry_set_ttl_t
+ */
+static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, void *instance,
+					  REQUEST *request, void *handle,
+					  rlm_cache_entry_t *c)
+{
+	rlm_cache_lfu_t *driver = talloc_get_type_abort(instance, rlm_cache_lfu_t);
+	rlm_cache_lfu_entry_t *e = (rlm_cache_lfu_entry_t *)c;
+
+	if (!request) return CACHE_ERROR;
+
+	(void) cache_stripe_lock(driver, request, handle, e->hash);
+
+	return CACHE_OK;
+}
+
+/** Return the number of entries in the cache
+ *
+ * @note handle not used except for sanity checks.
+ *
+ * @copydetails cache_entry_count_t
+ */
+static uint32_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void *instance,
+				  REQUEST *request, UNUSED void *handle)
+{
+	rlm_cache_lfu_t *driver = talloc_get_type_abort(instance, rlm_cache_lfu_t);
+
+	if (!request) return CACHE_ERROR;
+
+	return atomic_load_explicit(&driver->count, memory_order_relaxed);
+}
+
+/** Return the counters for the cache
+ *
+ * @copydetails cache_stats_t
+ */
+static void cache_stats(rlm_cache_stats_t *out, UNUSED rlm_cache_config_t const *config, void *instance)
+{
+	rlm_cache_lfu_t *driver = talloc_get_type_abort(instance, rlm_cache_lfu_t);
+
+	out->hits = atomic_load_explicit(&driver->hits, memory_order_relaxed);
+	out->misses = atomic_load_explicit(&driver->misses, memory_order_relaxed);
+	out->evictions = atomic_load_explicit(&driver->evictions, memory_order_relaxed);
+	out->rejected = atomic_load_explicit(&driver->rejected, memory_order_relaxed);
+	out->entries = atomic_load_explicit(&driver->count, memory_order_relaxed);
+	out->memory = atomic_load_explicit(&driver->memory, memory_order_relaxed);
+}
+
+typedef struct {
+	cache_entry_walk_cb_t	func;
+	void			*uctx;
+} rlm_cache_lfu_walk_t;
+
+/** Pass an entry in a stripe to the walk callback
+ *
+ */
+static int _cache_entry_walk(void *ctx, void *data)
+{
+	rlm_cache_lfu_walk_t *walk = ctx;
+
+	return walk->func(data, walk->uctx);
+}
+
+/** Call a function for every entry in the cache
+ *
+ * Each stripe is locked while it's walked, so requests for keys
+ * in other stripes aren't held up.
+ *
+ * @copydetails cache_entry_walk_t
+ */
+static int cache_entry_walk(UNUSED rlm_cache_config_t const *config, void *instance,
+			    cache_entry_walk_cb_t func, void *uctx)
+{
+	rlm_cache_lfu_t *driver = talloc_get_type_abort(instance, rlm_cache_lfu_t);
+	rlm_cache_lfu_walk_t walk = { .func = func, .uctx = uctx };
+	int i, ret;
+
+	for (i = 0; i < CACHE_LFU_STRIPES; i++) {
+		rlm_cache_lfu_stripe_t *stripe = &driver->stripe[i];
+
+		pthread_mutex_lock(&stripe->mutex);
+		ret = rbtree_walk(stripe->cache, RBTREE_IN_ORDER, _cache_entry_walk, &walk);
+		pthread_mutex_unlock(&stripe->mutex);
+
+		if (ret != 0) return -1;
+	}
+
+	return 0;
+}
+
+/** Get a handle for the request
+ *
+ * Nothing is locked until the first operation tells us which stripe
+ * the key is in.
+ *
+ * @copydetails cache_acquire_t
+ */
+static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+			 REQUEST *request)
+{
+	rlm_cache_lfu_handle_t *h;
+
+	h = talloc_zero(request, rlm_cache_lfu_handle_t);
+	if (!h) {
+		RERROR("Failed allocating handle");
+		return -1;
+	}
+	h->request = request;
+
+	*handle = h;
+
+	return 0;
+}
+
+/** Release an entry unlocking any mutexes
+ *
+ * @copydetails cache_release_t
+ */
+static void cache_release(UNUSED rlm_cache_config_t const *config, UNUSED void *instance, REQUEST *request,
+			  rlm_cache_handle_t *handle)
+{
+	rlm_cache_lfu_handle_t *h = talloc_get_type_abort(handle, rlm_cache_lfu_handle_t);
+
+	rad_assert(h->request == request);
+
+	if (h->locked) {
+		pthread_mutex_unlock(&h->locked->mutex);
+		RDEBUG3("Mutex released");
+	}
+
+	talloc_free(h);
+}
+
+extern cache_driver_t rlm_cache_lfu;
+cache_driver_t rlm_cache_lfu = {
+	.name		= "rlm_cache_lfu",
+	.magic		= RLM_MODULE_INIT,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.inst_size	= sizeof(rlm_cache_lfu_t),
+	.config		= driver_config,
+	.alloc		= cache_entry_alloc,
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+	.set_ttl	= cache_entry_set_ttl,
+	.count		= cache_entry_count,
+	.stats		= cache_stats,
+	.walk		= cache_entry_walk,
+
+	.acquire	= cache_acquire,
+	.release	= cache_release,
+};
@@ -17,7 +17,7 @@
 /**
  * $Id$
  * @file rlm_cache_rbtree.c
- * @brief Simple rbtree based cache.
+ * @brief Simple rbtree based cache, striped by key to reduce lock contention.
  *
  * @copyright 2014 The FreeRADIUS server project
  */
@@ -26,16 +26,54 @@
 #include <freeradius-devel/rad_assert.h>
 #include "../../rlm_cache.h"
 
-typedef struct rlm_cache_rbtree {
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+/** Number of independently locked trees entries are spread over
+ *
+ * Each key only ever lives in one stripe, so requests for different
+ * keys rarely wait on each other.
+ */
+#define CACHE_RBTREE_STRIPES	(32)
+
+/** Most entries to evict from a stripe, on each insert, when over the soft limit
+ *
+ */
+#define CACHE_RBTREE_EVICT_MAX	(4)
+
+typedef struct rlm_cache_rbtree_stripe {
 	rbtree_t		*cache;		//!< Tree for looking up cache keys.
 	fr_heap_t		*heap;		//!< For managing entry expiry.
 
 	pthread_mutex_t		mutex;		//!< Protect the tree from multiple readers/writers.
+	bool			mutex_init;	//!< Whether the mutex needs to be destroyed.
+} rlm_cache_rbtree_stripe_t;
+
+typedef struct rlm_cache_rbtree {
+	rlm_cache_rbtree_stripe_t	stripe[CACHE_RBTREE_STRIPES];
+
+	atomic_uint_fast32_t	count;		//!< Number of entries in all stripes.
+
+	fr_memory_t		*memory;	//!< Memory of the module, and its limits.
 } rlm_cache_rbtree_t;
 
+/** The stripe a request is using
+ *
+ * rlm_cache acquires a handle before it knows which entry it will
+ * touch, so the stripe is only locked on the first operation.
+ */
+typedef struct rlm_cache_rbtree_handle {
+	REQUEST				*request;	//!< For sanity checks.
+	rlm_cache_rbtree_stripe_t	*locked;	//!< Stripe we hold the mutex for, if any.
+} rlm_cache_rbtree_handle_t;
+
 typedef struct rlm_cache_rbtree_entry {
 	rlm_cache_entry_t	fields;		//!< Entry data.
 	size_t			offset;		//!< Offset used for heap.
+	size_t			size;		//!< Memory counted for the entry.
 } rlm_cache_rbtree_entry_t;
 
 /** Compare two entries by key
@@ -85,14 +123,19 @@ static int _cache_entry_free(UNUSED void *ctx, void *data)
 static int mod_detach(void *instance)
 {
 	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	int i;
 
-	if (driver->heap) talloc_free(driver->heap);
-	if (driver->cache) {
-		rbtree_walk(driver->cache, RBTREE_DELETE_ORDER, _cache_entry_free, NULL);
-		talloc_free(driver->cache);
-	}
+	for (i = 0; i < CACHE_RBTREE_STRIPES; i++) {
+		rlm_cache_rbtree_stripe_t *stripe = &driver->stripe[i];
 
-	pthread_mutex_destroy(&driver->mutex);
+		if (stripe->heap) talloc_free(stripe->heap);
+		if (stripe->cache) {
+			rbtree_walk(stripe->cache, RBTREE_DELETE_ORDER, _cache_entry_free, NULL);
+			talloc_free(stripe->cache);
+		}
+
+		if (stripe->mutex_init) pthread_mutex_destroy(&stripe->mutex);
+	}
 
 	return 0;
 }
@@ -101,37 +144,86 @@ static int mod_detach(void *instance)
  *
  * @copydetails cache_instantiate_t
  */
-static int mod_instantiate(UNUSED rlm_cache_config_t const *config, void *instance, UNUSED CONF_SECTION *conf)
+static int mod_instantiate(rlm_cache_config_t const *config, void *instance, UNUSED CONF_SECTION *conf)
 {
 	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	int i;
 
-	/*
-	 *	The cache.
-	 */
-	driver->cache = rbtree_create(NULL, cache_entry_cmp, NULL, 0);
-	if (!driver->cache) {
-		ERROR("Failed to create cache");
-		return -1;
-	}
-	fr_talloc_link_ctx(driver, driver->cache);
+	atomic_init(&driver->count, 0);
+	driver->memory = config->memory;
 
-	/*
-	 *	The heap of entries to expire.
-	 */
-	driver->heap = fr_heap_create(cache_heap_cmp, offsetof(rlm_cache_rbtree_entry_t, offset));
-	if (!driver->heap) {
-		ERROR("Failed to create heap for the cache");
-		return -1;
-	}
+	for (i = 0; i < CACHE_RBTREE_STRIPES; i++) {
+		rlm_cache_rbtree_stripe_t *stripe = &driver->stripe[i];
 
-	if (pthread_mutex_init(&driver->mutex, NULL) < 0) {
-		ERROR("Failed initializing mutex: %s", fr_syserror(errno));
-		return -1;
+		/*
+		 *	The cache.
+		 */
+		stripe->cache = rbtree_create(NULL, cache_entry_cmp, NULL, 0);
+		if (!stripe->cache) {
+			ERROR("Failed to create cache");
+			return -1;
+		}
+		fr_talloc_link_ctx(driver, stripe->cache);
+
+		/*
+		 *	The heap of entries to expire.
+		 */
+		stripe->heap = fr_heap_create(cache_heap_cmp, offsetof(rlm_cache_rbtree_entry_t, offset));
+		if (!stripe->heap) {
+			ERROR("Failed to create heap for the cache");
+			return -1;
+		}
+
+		if (pthread_mutex_init(&stripe->mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			return -1;
+		}
+		stripe->mutex_init = true;
 	}
 
 	return 0;
 }
 
+/** Lock the stripe a key lives in
+ *
+ * rlm_cache only works with one key between acquiring and releasing
+ * a handle, so a request holds at most one stripe.
+ */
+static rlm_cache_rbtree_stripe_t *cache_stripe_lock(rlm_cache_rbtree_t *driver, REQUEST *request,
+						    rlm_cache_rbtree_handle_t *handle,
+						    uint8_t const *key, size_t key_len)
+{
+	rlm_cache_rbtree_stripe_t *stripe;
+
+	stripe = &driver->stripe[fr_hash(key, key_len) % CACHE_RBTREE_STRIPES];
+	if (handle->locked == stripe) return stripe;
+
+	if (handle->locked) {
+		pthread_mutex_unlock(&handle->locked->mutex);
+		RDEBUG3("Mutex released");
+	}
+
+	pthread_mutex_lock(&stripe->mutex);
+	handle->locked = stripe;
+
+	RDEBUG3("Mutex acquired");
+
+	return stripe;
+}
+
+/** Remove an entry from its stripe, and free it
+ *
+ */
+static void cache_entry_remove(rlm_cache_rbtree_t *driver, rlm_cache_rbtree_stripe_t *stripe, rlm_cache_entry_t *c)
+{
+	fr_heap_extract(stripe->heap, c);
+	rbtree_deletebydata(stripe->cache, c);
+	if (driver->memory) fr_memory_add(driver->memory, -(int64_t) ((rlm_cache_rbtree_entry_t *)c)->size);
+	talloc_free(c);
+
+	atomic_fetch_sub_explicit(&driver->count, 1, memory_order_relaxed);
+}
+
 /** Custom allocation function for the driver
  *
  * Allows allocation of cache entry structures with additional fields.
@@ -153,37 +245,33 @@ static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *con
 }
 
 /** Locate a cache entry
- *
- * @note handle not used except for sanity checks.
  *
  * @copydetails cache_entry_find_t
  */
 static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 				       UNUSED rlm_cache_config_t const *config, void *instance,
-				       REQUEST *request, UNUSED void *handle, uint8_t const *key, size_t key_len)
+				       REQUEST *request, void *handle, uint8_t const *key, size_t key_len)
 {
 	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_stripe_t *stripe;
 
 	rlm_cache_entry_t *c, my_c;
 
-	rad_assert(driver->cache);
+	stripe = cache_stripe_lock(driver, request, handle, key, key_len);
+	rad_assert(stripe->cache);
 
 	/*
 	 *	Clear out old entries
 	 */
-	c = fr_heap_peek(driver->heap);
-	if (c && (c->expires < request->packet->timestamp.tv_sec)) {
-		fr_heap_extract(driver->heap, c);
-		rbtree_deletebydata(driver->cache, c);
-		talloc_free(c);
-	}
+	c = fr_heap_peek(stripe->heap);
+	if (c && (c->expires < request->packet->timestamp.tv_sec)) cache_entry_remove(driver, stripe, c);
 
 	/*
 	 *	Is there an entry for this key?
 	 */
 	my_c.key = key;
 	my_c.key_len = key_len;
-	c = rbtree_finddata(driver->cache, &my_c);
+	c = rbtree_finddata(stripe->cache, &my_c);
 	if (!c) {
 		*out = NULL;
 		return CACHE_MISS;
@@ -194,35 +282,32 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 }
 
 /** Free an entry and remove it from the data store
- *
- * @note handle not used except for sanity checks.
  *
  * @copydetails cache_entry_expire_t
  */
 static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
-					 REQUEST *request, UNUSED void *handle,
+					 REQUEST *request, void *handle,
 					 uint8_t const *key, size_t key_len)
 {
 	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_stripe_t *stripe;
 	rlm_cache_entry_t *c, my_c;
 
 	if (!request) return CACHE_ERROR;
 
+	stripe = cache_stripe_lock(driver, request, handle, key, key_len);
+
 	my_c.key = key;
 	my_c.key_len = key_len;
-	c = rbtree_finddata(driver->cache, &my_c);
+	c = rbtree_finddata(stripe->cache, &my_c);
 	if (!c) return CACHE_MISS;
 
-	fr_heap_extract(driver->heap, c);
-	rbtree_deletebydata(driver->cache, c);
-	talloc_free(c);
+	cache_entry_remove(driver, stripe, c);
 
 	return CACHE_OK;
 }
 
 /** Insert a new entry into the data store
- *
- * @note handle not used except for sanity checks.
  *
  * @copydetails cache_entry_insert_t
  */
@@ -233,64 +318,113 @@ static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void
 	cache_status_t status;
 
 	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_stripe_t *stripe;
 	rlm_cache_entry_t *my_c;
-
-	rad_assert(handle == request);
+	size_t size = 0;
+	int i;
 
 	if (!request) return CACHE_ERROR;
 
+	rad_assert(((rlm_cache_rbtree_handle_t *)handle)->request == request);
+
 	memcpy(&my_c, &c, sizeof(my_c));
 
+	/*
+	 *	Nothing else can see the entry yet, so it's safe to
+	 *	measure.
+	 */
+	if (driver->memory) size = talloc_total_size(my_c);
+
+	stripe = cache_stripe_lock(driver, request, handle, c->key, c->key_len);
+
+	if (driver->memory) {
+		/*
+		 *	Over the soft limit, evict the entries in this
+		 *	stripe which would expire soonest.
+		 */
+		for (i = 0; (i < CACHE_RBTREE_EVICT_MAX) && (fr_memory_limit(driver->memory) != FR_MEMORY_OK); i++) {
+			rlm_cache_entry_t *victim;
+
+			victim = fr_heap_peek(stripe->heap);
+			if (!victim) break;
+
+			cache_entry_remove(driver, stripe, victim);
+		}
+
+		/*
+		 *	Over the hard limit, don't store the entry.  As
+		 *	with any cache which evicts entries, rlm_cache
+		 *	sees a successful insert.
+		 */
+		if (!fr_memory_reserve(driver->memory, size)) {
+			RWDEBUG("Module memory is over its hard limit, not storing entry");
+			talloc_free(my_c);
+
+			return CACHE_OK;
+		}
+		((rlm_cache_rbtree_entry_t *)my_c)->size = size;
+	}
+
 	/*
 	 *	Allow overwriting
 	 */
-	if (!rbtree_insert(driver->cache, my_c)) {
+	if (!rbtree_insert(stripe->cache, my_c)) {
 		status = cache_entry_expire(config, instance, request, handle, c->key, c->key_len);
-		if ((status != CACHE_OK) && !rad_cond_assert(0)) return CACHE_ERROR;
+		if ((status != CACHE_OK) && !rad_cond_assert(0)) {
+			if (driver->memory) fr_memory_add(driver->memory, -(int64_t) size);
+			return CACHE_ERROR;
+		}
 
-		if (!rbtree_insert(driver->cache, my_c)) {
+		if (!rbtree_insert(stripe->cache, my_c)) {
 			RERROR("Failed adding entry");
+			if (driver->memory) fr_memory_add(driver->memory, -(int64_t) size);
 
 			return CACHE_ERROR;
 		}
 	}
 
-	if (!fr_heap_insert(driver->heap, my_c)) {
-		rbtree_deletebydata(driver->cache, my_c);
+	if (!fr_heap_insert(stripe->heap, my_c)) {
+		rbtree_deletebydata(stripe->cache, my_c);
 		RERROR("Failed adding entry to expiry heap");
+		if (driver->memory) fr_memory_add(driver->memory, -(int64_t) size);
 
 		return CACHE_ERROR;
 	}
 
+	atomic_fetch_add_explicit(&driver->count, 1, memory_order_relaxed);
+
 	return CACHE_OK;
 }
 
 /** Update the TTL of an entry
- *
- * @note handle not used except for sanity checks.
  *
  * @copydetails cache_entry_set_ttl_t
  */
 static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, void *instance,
-					  REQUEST *request, UNUSED void *handle,
+					  REQUEST *request, void *handle,
 					  rlm_cache_entry_t *c)
 {
 	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_stripe_t *stripe;
 	int ret;
 
 #ifdef NDEBUG
 	if (!request) return CACHE_ERROR;
 #endif
 
-	ret = fr_heap_extract(driver->heap, c);
+	stripe = cache_stripe_lock(driver, request, handle, c->key, c->key_len);
+
+	ret = fr_heap_extract(stripe->heap, c);
 	rad_assert(ret == 1);
 	if (ret != 1) {					/* Need this check if we're not building with asserts */
 		RERROR("Entry not in heap");
 		return CACHE_ERROR;
 	}
 
-	if (!fr_heap_insert(driver->heap, c)) {
-		rbtree_deletebydata(driver->cache, c);	/* make sure we don't leak entries... */
+	if (!fr_heap_insert(stripe->heap, c)) {
+		rbtree_deletebydata(stripe->cache, c);	/* make sure we don't leak entries... */
+		atomic_fetch_sub_explicit(&driver->count, 1, memory_order_relaxed);
+		if (driver->memory) fr_memory_add(driver->memory, -(int64_t) ((rlm_cache_rbtree_entry_t *)c)->size);
 		RERROR("Failed updating entry TTL.  Entry was forcefully expired");
 		return CACHE_ERROR;
 	}
@@ -310,43 +444,92 @@ static uint32_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void
 
 	if (!request) return CACHE_ERROR;
 
-	return rbtree_num_elements(driver->cache);
+	return atomic_load_explicit(&driver->count, memory_order_relaxed);
 }
 
-/** Lock the rbtree
+typedef struct {
+	cache_entry_walk_cb_t	func;
+	void			*uctx;
+} rlm_cache_rbtree_walk_t;
+
+/** Pass an entry in a stripe to the walk callback
  *
- * @note handle not used except for sanity checks.
+ */
+static int _cache_entry_walk(void *ctx, void *data)
+{
+	rlm_cache_rbtree_walk_t *walk = ctx;
+
+	return walk->func(data, walk->uctx);
+}
+
+/** Call a function for every entry in the cache
  *
- * @copydetails cache_acquire_t
+ * Each stripe is locked while it's walked, so requests for keys
+ * in other stripes aren't held up.
+ *
+ * @copydetails cache_entry_walk_t
  */
-static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, void *instance,
-			 REQUEST *request)
+static int cache_entry_walk(UNUSED rlm_cache_config_t const *config, void *instance,
+			    cache_entry_walk_cb_t func, void *uctx)
 {
 	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_walk_t walk = { .func = func, .uctx = uctx };
+	int i, ret;
 
-	pthread_mutex_lock(&driver->mutex);
+	for (i = 0; i < CACHE_RBTREE_STRIPES; i++) {
+		rlm_cache_rbtree_stripe_t *stripe = &driver->stripe[i];
 
-	*handle = request;		/* handle is unused, this is just for sanity checking */
+		pthread_mutex_lock(&stripe->mutex);
+		ret = rbtree_walk(stripe->cache, RBTREE_IN_ORDER, _cache_entry_walk, &walk);
+		pthread_mutex_unlock(&stripe->mutex);
 
-	RDEBUG3("Mutex acquired");
+		if (ret != 0) return -1;
+	}
 
 	return 0;
 }
 
-/** Release an entry unlocking any mutexes
+/** Get a handle for the request
  *
- * @note handle not used except for sanity checks.
+ * Nothing is locked until the first operation tells us which stripe
+ * the key is in.
+ *
+ * @copydetails cache_acquire_t
+ */
+static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+			 REQUEST *request)
+{
+	rlm_cache_rbtree_handle_t *h;
+
+	h = talloc_zero(request, rlm_cache_rbtree_handle_t);
+	if (!h) {
+		RERROR("Failed allocating handle");
+		return -1;
+	}
+	h->request = request;
+
+	*handle = h;
+
+	return 0;
+}
+
+/** Release an entry unlocking any mutexes
  *
  * @copydetails cache_release_t
  */
-static void cache_release(UNUSED rlm_cache_config_t const *config, void *instance, REQUEST *request,
-			  UNUSED rlm_cache_handle_t *handle)
+static void cache_release(UNUSED rlm_cache_config_t const *config, UNUSED void *instance, REQUEST *request,
+			  rlm_cache_handle_t *handle)
 {
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_handle_t *h = talloc_get_type_abort(handle, rlm_cache_rbtree_handle_t);
+
+	rad_assert(h->request == request);
 
-	pthread_mutex_unlock(&driver->mutex);
+	if (h->locked) {
+		pthread_mutex_unlock(&h->locked->mutex);
+		RDEBUG3("Mutex released");
+	}
 
-	RDEBUG3("Mutex released");
+	talloc_free(h);
 }
 
 extern cache_driver_t rlm_cache_rbtree;
@@ -363,6 +546,7 @@ cache_driver_t rlm_cache_rbtree = {
 	.expire		= cache_entry_expire,
 	.set_ttl	= cache_entry_set_ttl,
 	.count		= cache_entry_count,
+	.walk		= cache_entry_walk,
 
 	.acquire	= cache_acquire,
 	.release	= cache_release,
@@ -24,6 +24,7 @@
 #define LOG_PREFIX "rlm_cache_redis - "
 
 #include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
 
 #include "../../rlm_cache.h"
@@ -41,10 +42,60 @@ typedef struct rlm_cache_redis {
 
 	vp_tmpl_t		*created_attr;	//!< LHS of the Cache-Created map.
 	vp_tmpl_t		*expires_attr;	//!< LHS of the Cache-Expires map.
+	vp_tmpl_t		*negative_attr;	//!< LHS of the Cache-Negative map.
 
 	fr_redis_cluster_t	*cluster;
 } rlm_cache_redis_t;
 
+typedef struct rlm_cache_redis_thread {
+	fr_redis_cluster_thread_t	*cluster;	//!< Async cluster state for this thread.
+} rlm_cache_redis_thread_t;
+
+/** Which callback issued a command
+ */
+typedef enum {
+	CACHE_REDIS_FIND = 0,
+	CACHE_REDIS_INSERT,
+	CACHE_REDIS_EXPIRE
+} cache_redis_op_t;
+
+static char const *cache_redis_op_str[] = {
+	[CACHE_REDIS_FIND]	= "retrieving",
+	[CACHE_REDIS_INSERT]	= "inserting",
+	[CACHE_REDIS_EXPIRE]	= "expiring"
+};
+
+/** A command issued for a request
+ *
+ * Kept as request data while the request is yielded.  When it resumes,
+ * rlm_cache calls us again, and we hand over the result.
+ */
+typedef struct {
+	fr_redis_cluster_async_t *cmd;		//!< Command in flight, NULL once the reply is received.
+	cache_redis_op_t	op;		//!< Which callback issued the command.
+	uint8_t const		*key;		//!< Key the command was issued for.
+	size_t			key_len;	//!< Length of key data.
+	cache_status_t		status;		//!< Result of the command.
+	rlm_cache_entry_t	*c;		//!< Entry found by #CACHE_REDIS_FIND.
+} rlm_cache_redis_async_t;
+
+/*
+ *	Replaces an entry, and sets its expiry time, in a single command.
+ *
+ *	Commands on the async connections are redirected one at a time, so
+ *	a MULTI/EXEC transaction could be split between two nodes.
+ *
+ *	KEYS[1] is the entry, ARGV[1] its expiry time, and the rest of ARGV
+ *	are the serialized maps.
+ */
+static char const cache_insert_script[] =
+	"redis.call('DEL', KEYS[1])\n"
+	"redis.call('RPUSH', KEYS[1], unpack(ARGV, 2))\n"
+	"if tonumber(ARGV[1]) > 0 then\n"
+	"  redis.call('EXPIREAT', KEYS[1], ARGV[1])\n"
+	"end\n"
+	"return 1";
+
 /** Create a new rlm_cache_redis instance
  *
  * @copydetails cache_instantiate_t
@@ -83,9 +134,42 @@ static int mod_instantiate(rlm_cache_config_t const *config, void *instance, CON
 		return -1;
 	}
 
+	if (tmpl_afrom_attr_str(driver, &driver->negative_attr, "&Cache-Negative",
+			        REQUEST_CURRENT, PAIR_LIST_REQUEST, false, false) < 0) {
+		ERROR("Cache-Negative attribute not defined");
+		return -1;
+	}
+
 	return 0;
 }
 
+/** Create this worker's async connections
+ *
+ * @copydetails cache_thread_instantiate_t
+ */
+static int mod_thread_instantiate(UNUSED rlm_cache_config_t const *config, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_cache_redis_t		*driver = instance;
+	rlm_cache_redis_thread_t	*t = thread;
+
+	t->cluster = fr_redis_cluster_thread_alloc(NULL, driver->cluster, el);
+	if (!t->cluster) return -1;
+
+	return 0;
+}
+
+/** Close this worker's async connections
+ *
+ * @copydetails cache_thread_detach_t
+ */
+static void mod_thread_detach(UNUSED rlm_cache_config_t const *config, UNUSED void *instance, void *thread)
+{
+	rlm_cache_redis_thread_t	*t = thread;
+
+	talloc_free(t->cluster);
+}
+
 static int mod_load(void)
 {
 	fr_redis_version_print();
@@ -97,78 +181,44 @@ static void cache_entry_free(rlm_cache_entry_t *c)
 	talloc_free(c);
 }
 
-/** Locate a cache entry in redis
+/** Convert the reply to LRANGE into a cache entry
  *
- * @copydetails cache_entry_find_t
+ * @param[out] out	Where to write the new entry.
+ * @param[in] request	The current request.
+ * @param[in] reply	to LRANGE.  Not freed.
+ * @param[in] key	of the entry.
+ * @param[in] key_len	the length of the key.
+ * @return
+ *	- #CACHE_OK if an entry was found.
+ *	- #CACHE_MISS if there was no entry.
+ *	- #CACHE_ERROR if the reply couldn't be converted.
  */
-static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
-				       UNUSED rlm_cache_config_t const *config, void *instance,
-				       REQUEST *request, UNUSED void *handle, uint8_t const *key, size_t key_len)
+static cache_status_t cache_entry_from_reply(rlm_cache_entry_t **out, REQUEST *request, redisReply *reply,
+					     uint8_t const *key, size_t key_len)
 {
-	rlm_cache_redis_t		*driver = instance;
 	size_t				i;
 
-	fr_redis_cluster_state_t	state;
-	fr_redis_conn_t			*conn;
-	fr_redis_rcode_t		status;
-	redisReply			*reply = NULL;
-	int				s_ret;
-
 	vp_map_t			*head = NULL, **last = &head;
 #ifdef HAVE_TALLOC_POOLED_OBJECT
 	size_t				pool_size = 0;
 #endif
 	rlm_cache_entry_t		*c;
 
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, key, key_len, false);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, driver->cluster, request, status, &reply)) {
-		/*
-		 *	Grab all the data for this hash, should return an array
-		 *	of alternating keys/values which we then convert into maps.
-		 */
-		if (RDEBUG_ENABLED3) {
-			char *p;
-
-			p = fr_asprint(NULL, (char const *)key, key_len, '"');
-			RDEBUG3("LRANGE %s 0 -1", key);
-			talloc_free(p);
-		}
-		reply = redisCommand(conn->handle, "LRANGE %b 0 -1", key, key_len);
-		status = fr_redis_command_status(conn, reply);
-	}
-	if (s_ret != REDIS_RCODE_SUCCESS) {
-		char *p;
-
-		p = fr_asprint(NULL, (char const *)key, key_len, '"');
-		RERROR("Failed retrieving entry for key \"%s\"", p);
-		talloc_free(p);
-
-	error:
-		fr_redis_reply_free(reply);
-		return CACHE_ERROR;
-	}
-
-	if (!rad_cond_assert(reply)) goto error;
-
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Bad result type, expected array, got %s",
 			fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
-		goto error;
+		return CACHE_ERROR;
 	}
 
 	RDEBUG3("Entry contains %zu elements", reply->elements);
 
-	if (reply->elements == 0) {
-		fr_redis_reply_free(reply);
-		return CACHE_MISS;
-	}
+	if (reply->elements == 0) return CACHE_MISS;
 
 	if (reply->elements % 3) {
 		REDEBUG("Invalid number of reply elements (%zu).  "
 			"Reply must contain triplets of keys operators and values",
 			reply->elements);
-		goto error;
+		return CACHE_ERROR;
 	}
 
 #ifdef HAVE_TALLOC_POOLED_OBJECT
@@ -197,17 +247,15 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		if (fr_redis_reply_to_map(c, last, request,
 					  reply->element[i], reply->element[i + 1], reply->element[i + 2]) < 0) {
 			talloc_free(c);
-			fr_redis_reply_free(reply);
 			return CACHE_ERROR;
 		}
 		last = &(*last)->next;
 	}
-	fr_redis_reply_free(reply);
 
 	/*
 	 *	Pull out the cache created date
 	 */
-	if ((head->lhs->tmpl_da->vendor == 0) && (head->lhs->tmpl_da->attr == FR_CACHE_CREATED)) {
+	if (head && (head->lhs->tmpl_da->vendor == 0) && (head->lhs->tmpl_da->attr == FR_CACHE_CREATED)) {
 		vp_map_t *map;
 
 		c->created = head->rhs->tmpl_value.vb_date;
@@ -220,7 +268,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 	/*
 	 *	Pull out the cache expires date
 	 */
-	if ((head->lhs->tmpl_da->vendor == 0) && (head->lhs->tmpl_da->attr == FR_CACHE_EXPIRES)) {
+	if (head && (head->lhs->tmpl_da->vendor == 0) && (head->lhs->tmpl_da->attr == FR_CACHE_EXPIRES)) {
 		vp_map_t *map;
 
 		c->expires = head->rhs->tmpl_value.vb_date;
@@ -230,6 +278,19 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		talloc_free(map);
 	}
 
+	/*
+	 *	Negative entries have a marker instead of maps
+	 */
+	if (head && (head->lhs->tmpl_da->vendor == 0) && (head->lhs->tmpl_da->attr == FR_CACHE_NEGATIVE)) {
+		vp_map_t *map;
+
+		c->negative = (head->rhs->tmpl_value.vb_uint32 > 0);
+
+		map = head;
+		head = head->next;
+		talloc_free(map);
+	}
+
 	c->key = talloc_memdup(c, key, key_len);
 	c->key_len = key_len;
 	c->maps = head;
@@ -238,13 +299,302 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 	return CACHE_OK;
 }
 
+/** Convert the reply to DEL into a cache status
+ *
+ */
+static cache_status_t cache_expire_from_reply(REQUEST *request, redisReply *reply)
+{
+	if (reply->type == REDIS_REPLY_INTEGER) {
+		if (reply->integer) return CACHE_OK;    /* Affected */
+		return CACHE_MISS;
+	}
+
+	REDEBUG("Bad result type, expected integer, got %s",
+		fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
+
+	return CACHE_ERROR;
+}
+
+/** Stop waiting for a command's reply, if the request goes away first
+ *
+ */
+static int _cache_async_free(rlm_cache_redis_async_t *async)
+{
+	if (async->cmd) fr_redis_cluster_async_cancel(async->cmd);
+	talloc_free(async->c);
+
+	return 0;
+}
+
+/** Record the result of a command, and resume the request
+ *
+ */
+static void _cache_async_reply(REQUEST *request, fr_redis_rcode_t status, redisReply *reply, void *uctx)
+{
+	rlm_cache_redis_async_t	*async = uctx;
+
+	async->cmd = NULL;
+
+	if ((status != REDIS_RCODE_SUCCESS) || !rad_cond_assert(reply)) {
+		char *p;
+
+		p = fr_asprint(NULL, (char const *)async->key, async->key_len, '"');
+		RERROR("Failed %s entry for key \"%s\"", cache_redis_op_str[async->op], p);
+		talloc_free(p);
+
+		async->status = CACHE_ERROR;
+		goto finish;
+	}
+
+	switch (async->op) {
+	case CACHE_REDIS_FIND:
+		async->status = cache_entry_from_reply(&async->c, request, reply, async->key, async->key_len);
+		break;
+
+	case CACHE_REDIS_INSERT:
+		RDEBUG3("Command result");
+		RINDENT();
+		fr_redis_reply_print(L_DBG_LVL_3, reply, request, 0);
+		REXDENT();
+		async->status = CACHE_OK;
+		break;
+
+	case CACHE_REDIS_EXPIRE:
+		async->status = cache_expire_from_reply(request, reply);
+		break;
+	}
+
+finish:
+	unlang_resumable(request);
+}
+
+/** Send a command to the node which owns the key, and yield the request
+ *
+ * Commands sent by other requests in the same pass of the event loop
+ * are pipelined with this one.
+ *
+ * @return
+ *	- #CACHE_YIELD if the command was sent.
+ *	- #CACHE_ERROR on failure.
+ */
+static cache_status_t cache_async_command(rlm_cache_redis_t *driver, rlm_cache_redis_thread_t *t, REQUEST *request,
+					  cache_redis_op_t op, uint8_t const *key, size_t key_len,
+					  int argc, char const **argv, size_t const *argv_len)
+{
+	rlm_cache_redis_async_t	*async;
+
+	MEM(async = talloc_zero(request, rlm_cache_redis_async_t));
+	async->op = op;
+	async->key = talloc_memdup(async, key, key_len);
+	async->key_len = key_len;
+
+	async->cmd = fr_redis_cluster_async_command(t->cluster, request, key, key_len, false,
+						    argc, argv, argv_len, _cache_async_reply, async);
+	if (!async->cmd) {
+		RPERROR("Failed %s entry", cache_redis_op_str[op]);
+		talloc_free(async);
+		return CACHE_ERROR;
+	}
+	talloc_set_destructor(async, _cache_async_free);
+
+	if (request_data_add(request, driver, 0, async, true, true, false) < 0) {
+		RERROR("Failed recording command");
+		talloc_free(async);
+		return CACHE_ERROR;
+	}
+
+	return CACHE_YIELD;
+}
+
+/** Get the command we sent before the request yielded
+ *
+ * @return
+ *	- the command.  The caller must free it.
+ *	- NULL if there was no command, or it was for another key.
+ */
+static rlm_cache_redis_async_t *cache_async_result(rlm_cache_redis_t *driver, REQUEST *request,
+						   uint8_t const *key, size_t key_len)
+{
+	rlm_cache_redis_async_t	*async;
+
+	async = request_data_get(request, driver, 0);
+	if (!async) return NULL;
+
+	if (async->cmd || (async->key_len != key_len) || (memcmp(async->key, key, key_len) != 0)) {
+		talloc_free(async);
+		return NULL;
+	}
+
+	return async;
+}
+
+/** Stop waiting for a reply
+ *
+ * @copydetails cache_cancel_t
+ */
+static void cache_async_cancel(UNUSED rlm_cache_config_t const *config, void *instance, REQUEST *request)
+{
+	talloc_free(request_data_get(request, instance, 0));
+}
+
+/** Locate a cache entry in redis
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, void *instance,
+				       REQUEST *request, void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_redis_t		*driver = instance;
+
+	fr_redis_cluster_state_t	state;
+	fr_redis_conn_t			*conn;
+	fr_redis_rcode_t		status;
+	redisReply			*reply = NULL;
+	int				s_ret;
+	cache_status_t			ret;
+
+	/*
+	 *	If the request has resumed, hand over what we found
+	 */
+	if (handle) {
+		rlm_cache_redis_async_t	*async;
+
+		async = cache_async_result(driver, request, key, key_len);
+		if (async && (async->op == CACHE_REDIS_FIND)) {
+			*out = async->c;
+			async->c = NULL;
+			ret = async->status;
+			talloc_free(async);
+
+			return ret;
+		}
+
+		/*
+		 *	rlm_cache looks again after removing
+		 *	an expired entry.
+		 */
+		if (async && (async->op == CACHE_REDIS_EXPIRE)) {
+			talloc_free(async);
+			return CACHE_MISS;
+		}
+		talloc_free(async);
+	}
+
+	if (RDEBUG_ENABLED3) {
+		char *p;
+
+		p = fr_asprint(NULL, (char const *)key, key_len, '"');
+		RDEBUG3("LRANGE %s 0 -1", p);
+		talloc_free(p);
+	}
+
+	/*
+	 *	Called by a worker, use its async connections
+	 */
+	if (handle) {
+		char const		*argv[] = { "LRANGE", (char const *)key, "0", "-1" };
+		size_t			argv_len[] = { 6, key_len, 1, 2 };
+
+		return cache_async_command(driver, handle, request, CACHE_REDIS_FIND, key, key_len,
+					   4, argv, argv_len);
+	}
+
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, key, key_len, false);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, driver->cluster, request, status, &reply)) {
+		/*
+		 *	Grab all the data for this hash, should return an array
+		 *	of alternating keys/values which we then convert into maps.
+		 */
+		reply = redisCommand(conn->handle, "LRANGE %b 0 -1", key, key_len);
+		status = fr_redis_command_status(conn, reply);
+	}
+	if (s_ret != REDIS_RCODE_SUCCESS) {
+		char *p;
+
+		p = fr_asprint(NULL, (char const *)key, key_len, '"');
+		RERROR("Failed retrieving entry for key \"%s\"", p);
+		talloc_free(p);
+
+	error:
+		fr_redis_reply_free(reply);
+		return CACHE_ERROR;
+	}
+
+	if (!rad_cond_assert(reply)) goto error;
+
+	ret = cache_entry_from_reply(out, request, reply, key, key_len);
+	fr_redis_reply_free(reply);
+
+	return ret;
+}
+
+
+/** Replace an entry using the worker's async connections
+ *
+ * @param[in] driver	instance.
+ * @param[in] t		thread instance.
+ * @param[in] request	The current request.
+ * @param[in] c		to insert.
+ * @param[in] argv	of the RPUSH command for the entry.
+ * @param[in] argv_len	lengths of the arguments.
+ * @return
+ *	- #CACHE_YIELD if the command was sent.
+ *	- #CACHE_ERROR on failure.
+ */
+static cache_status_t cache_insert_async(rlm_cache_redis_t *driver, rlm_cache_redis_thread_t *t, REQUEST *request,
+					 rlm_cache_entry_t const *c, char const **argv, size_t const *argv_len)
+{
+	size_t		argc = talloc_array_length(argv);
+	char const	**eval;
+	size_t		*eval_len;
+	char		expires[32];
+	cache_status_t	ret;
+
+	snprintf(expires, sizeof(expires), "%li", (c->expires > 0) ? (long)c->expires : 0);
+
+	if (RDEBUG_ENABLED3) {
+		char *p;
+
+		p = fr_asprint(request, (char const *)c->key, c->key_len, '\"');
+		RDEBUG3("EVAL <insert script> 1 \"%s\" %s <%zu maps>", p, expires, (argc - 2) / 3);
+		talloc_free(p);
+	}
+
+	/*
+	 *	EVAL <script> 1 <key> <expires> <maps>...
+	 */
+	MEM(eval = talloc_array(request, char const *, argc + 3));
+	MEM(eval_len = talloc_array(request, size_t, argc + 3));
+
+	eval[0] = "EVAL";
+	eval_len[0] = 4;
+	eval[1] = cache_insert_script;
+	eval_len[1] = sizeof(cache_insert_script) - 1;
+	eval[2] = "1";
+	eval_len[2] = 1;
+	eval[3] = argv[1];
+	eval_len[3] = argv_len[1];
+	eval[4] = expires;
+	eval_len[4] = strlen(expires);
+	memcpy(eval + 5, argv + 2, (argc - 2) * sizeof(*eval));
+	memcpy(eval_len + 5, argv_len + 2, (argc - 2) * sizeof(*eval_len));
+
+	ret = cache_async_command(driver, t, request, CACHE_REDIS_INSERT, c->key, c->key_len,
+				  argc + 3, eval, eval_len);
+	talloc_free(eval);
+	talloc_free(eval_len);
+
+	return ret;
+}
 
 /** Insert a new entry into the data store
  *
  * @copydetails cache_entry_insert_t
  */
 static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
-					 REQUEST *request, UNUSED void *handle, const rlm_cache_entry_t *c)
+					 REQUEST *request, void *handle, const rlm_cache_entry_t *c)
 {
 	rlm_cache_redis_t	*driver = instance;
 	TALLOC_CTX		*pool;
@@ -270,6 +620,13 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 	char			*p;
 	int			cnt;
 
+	vp_tmpl_t		negative_value;
+	vp_map_t		negative = {
+					.op	= T_OP_SET,
+					.lhs	= driver->negative_attr,
+					.rhs	= &negative_value,
+				};
+
 	vp_tmpl_t		expires_value;
 	vp_map_t		expires = {
 					.op	= T_OP_SET,
@@ -285,6 +642,23 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 					.next	= &expires
 				};
 
+	/*
+	 *	If the request has resumed, hand over the result
+	 */
+	if (handle) {
+		rlm_cache_redis_async_t	*async;
+		cache_status_t		ret;
+
+		async = cache_async_result(driver, request, c->key, c->key_len);
+		if (async && (async->op == CACHE_REDIS_INSERT)) {
+			ret = async->status;
+			talloc_free(async);
+
+			return ret;
+		}
+		talloc_free(async);
+	}
+
 	/*
 	 *	Encode the entry created date
 	 */
@@ -303,6 +677,17 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 	expires_value.tmpl_value.vb_date = c->expires;
 	expires.next = c->maps;	/* Head of the list */
 
+	/*
+	 *	Mark negative entries, which have no maps
+	 */
+	if (c->negative) {
+		tmpl_init(&negative_value, TMPL_TYPE_DATA, "<TEMP>", 6, T_BARE_WORD);
+		negative_value.tmpl_value_type = FR_TYPE_UINT32;
+		negative_value.tmpl_value.vb_uint32 = 1;
+		negative.next = c->maps;
+		expires.next = &negative;
+	}
+
 	for (cnt = 0, map = &created; map; cnt++, map = map->next);
 
 	/*
@@ -335,6 +720,18 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 		argv_len_p += 3;
 	}
 
+	/*
+	 *	Called by a worker, use its async connections
+	 */
+	if (handle) {
+		cache_status_t	ret;
+
+		ret = cache_insert_async(driver, handle, request, c, argv, argv_len);
+		talloc_free(pool);
+
+		return ret;
+	}
+
 	RDEBUG3("Pipelining commands");
 
 	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, c->key, c->key_len, false);
@@ -423,7 +820,7 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
  * @copydetails cache_entry_expire_t
  */
 static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
-					 REQUEST *request, UNUSED void *handle, uint8_t const *key, size_t key_len)
+					 REQUEST *request, void *handle, uint8_t const *key, size_t key_len)
 {
 	rlm_cache_redis_t		*driver = instance;
 	fr_redis_cluster_state_t	state;
@@ -433,6 +830,27 @@ static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config
 	int				s_ret;
 	cache_status_t			cache_status;
 
+	if (handle) {
+		rlm_cache_redis_async_t	*async;
+		char const		*argv[] = { "DEL", (char const *)key };
+		size_t			argv_len[] = { 3, key_len };
+
+		/*
+		 *	If the request has resumed, hand over the result
+		 */
+		async = cache_async_result(driver, request, key, key_len);
+		if (async && (async->op == CACHE_REDIS_EXPIRE)) {
+			cache_status = async->status;
+			talloc_free(async);
+
+			return cache_status;
+		}
+		talloc_free(async);
+
+		return cache_async_command(driver, handle, request, CACHE_REDIS_EXPIRE, key, key_len,
+					   2, argv, argv_len);
+	}
+
 	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, key, key_len, false);
 	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
 	     s_ret = fr_redis_cluster_state_next(&state, &conn, driver->cluster, request, status, &reply)) {
@@ -448,18 +866,10 @@ static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config
 	}
 	if (!rad_cond_assert(reply)) goto error;
 
-	if (reply->type == REDIS_REPLY_INTEGER) {
-		cache_status = CACHE_MISS;
-		if (reply->integer) cache_status = CACHE_OK;    /* Affected */
-		fr_redis_reply_free(reply);
-		return cache_status;
-	}
-
-	REDEBUG("Bad result type, expected integer, got %s",
-		fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
+	cache_status = cache_expire_from_reply(request, reply);
 	fr_redis_reply_free(reply);
 
-	return CACHE_ERROR;
+	return cache_status;
 }
 
 extern cache_driver_t rlm_cache_redis;
@@ -472,7 +882,12 @@ cache_driver_t rlm_cache_redis = {
 	.config		= driver_config,
 	.free		= cache_entry_free,
 
+	.thread_inst_size	= sizeof(rlm_cache_redis_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
+
 	.find		= cache_entry_find,
 	.insert		= cache_entry_insert,
 	.expire		= cache_entry_expire,
+	.cancel		= cache_async_cancel,
 };
@@ -0,0 +1,288 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file l1.c
+ * @brief A small cache in each worker, in front of the driver.
+ *
+ * Drivers such as rlm_cache_redis go to the network for every lookup,
+ * even for entries which every worker reads many times a second.  The
+ * L1 keeps the entries a worker found recently, for a short time.
+ *
+ * Each worker has its own L1, so it's only ever touched by one thread,
+ * and needs no locks.  Entries are kept for at most "l1.ttl" seconds,
+ * and the least recently used entry is dropped when the L1 is full.
+ *
+ * The entries are the ones the driver returned from find(), which
+ * would otherwise have been freed.  So filling the L1 costs nothing
+ * but a tree insert.  Only drivers which hand over their entries, i.e.
+ * which have a free() callback, can have an L1.
+ *
+ * When any worker writes or expires an entry, the generation of its key
+ * is bumped, and every L1 drops its copy the next time it's found.
+ * Other servers sharing the driver's datastore aren't seen, so their
+ * changes may take up to "l1.ttl" seconds to appear.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/rbtree.h>
+
+#include "rlm_cache.h"
+#include "l1.h"
+
+struct cache_l1 {
+	rlm_cache_t const	*inst;
+	rbtree_t		*tree;			//!< Entries, by key.
+	fr_dlist_t		lru;			//!< Entries, most recently used first.
+	uint32_t		count;			//!< Entries in the L1.
+};
+
+typedef struct {
+	cache_l1_t		*l1;			//!< The L1 we're in.
+	uint8_t const		*key;			//!< Key of the entry.
+	size_t			key_len;		//!< Length of key data.
+	rlm_cache_entry_t	*c;			//!< The entry.  Owned by us.
+	time_t			expires;		//!< When we stop using it.
+	uint32_t		gen;			//!< Generation of the key when the entry was found.
+	size_t			size;			//!< Memory counted for the entry.
+	fr_dlist_t		entry;			//!< In the LRU list.
+} cache_l1_entry_t;
+
+/** Allocate the state shared by the L1s of all workers
+ *
+ */
+cache_l1_shared_t *cache_l1_shared_alloc(TALLOC_CTX *ctx)
+{
+	cache_l1_shared_t	*shared;
+	size_t			i;
+
+	shared = talloc_zero(ctx, cache_l1_shared_t);
+	if (!shared) return NULL;
+
+	atomic_init(&shared->hits, 0);
+	atomic_init(&shared->misses, 0);
+	for (i = 0; i < CACHE_L1_GENERATIONS; i++) atomic_init(&shared->gen[i], 0);
+
+	return shared;
+}
+
+static inline atomic_uint *cache_l1_gen(cache_l1_shared_t *shared, uint8_t const *key, size_t key_len)
+{
+	return &shared->gen[fr_hash(key, key_len) & (CACHE_L1_GENERATIONS - 1)];
+}
+
+/** Get the generation of a key
+ *
+ * Must be called before the driver is asked for the entry, so that a
+ * write which races with the lookup makes the entry look old.
+ */
+uint32_t cache_l1_generation(cache_l1_shared_t *shared, uint8_t const *key, size_t key_len)
+{
+	return atomic_load_explicit(cache_l1_gen(shared, key, key_len), memory_order_acquire);
+}
+
+/** Tell every L1 that an entry has changed
+ *
+ * Must be called after the driver has written, or expired, the entry.
+ */
+void cache_l1_invalidate(cache_l1_shared_t *shared, uint8_t const *key, size_t key_len)
+{
+	atomic_fetch_add_explicit(cache_l1_gen(shared, key, key_len), 1, memory_order_release);
+}
+
+static int cache_l1_cmp(void const *one, void const *two)
+{
+	cache_l1_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+static int _cache_l1_entry_free(cache_l1_entry_t *e)
+{
+	cache_l1_t *l1 = e->l1;
+
+	rbtree_deletebydata(l1->tree, e);
+	fr_dlist_remove(&e->entry);
+	l1->count--;
+
+	if (l1->inst->config.memory) fr_memory_add(l1->inst->config.memory, -(int64_t) e->size);
+
+	return 0;
+}
+
+static int _cache_l1_free(cache_l1_t *l1)
+{
+	fr_dlist_t *entry;
+
+	while ((entry = FR_DLIST_FIRST(l1->lru))) {
+		talloc_free(fr_ptr_to_type(cache_l1_entry_t, entry, entry));
+	}
+
+	return 0;
+}
+
+/** Allocate an L1 for a worker
+ *
+ * @param[in] ctx	to allocate the L1 in.
+ * @param[in] inst	of rlm_cache.
+ * @return
+ *	- NULL on error.
+ *	- the new L1.
+ */
+cache_l1_t *cache_l1_alloc(TALLOC_CTX *ctx, rlm_cache_t const *inst)
+{
+	cache_l1_t *l1;
+
+	l1 = talloc_zero(ctx, cache_l1_t);
+	if (!l1) return NULL;
+
+	l1->inst = inst;
+	FR_DLIST_INIT(l1->lru);
+
+	l1->tree = rbtree_create(l1, cache_l1_cmp, NULL, 0);
+	if (!l1->tree) {
+		talloc_free(l1);
+		return NULL;
+	}
+	talloc_set_destructor(l1, _cache_l1_free);
+
+	return l1;
+}
+
+/** Find an entry in the L1
+ *
+ * @param[in] l1	of this worker.
+ * @param[in] key	of the entry.
+ * @param[in] key_len	the length of the key.
+ * @param[in] now	the time of the request.
+ * @return
+ *	- the entry.  It belongs to the L1, and must not be kept after
+ *	  the module returns.
+ *	- NULL if it isn't in the L1, or it's too old.
+ */
+rlm_cache_entry_t *cache_l1_find(cache_l1_t *l1, uint8_t const *key, size_t key_len, time_t now)
+{
+	cache_l1_shared_t	*shared = l1->inst->l1;
+	cache_l1_entry_t	my_e, *e;
+
+	my_e.key = key;
+	my_e.key_len = key_len;
+
+	e = rbtree_finddata(l1->tree, &my_e);
+	if (!e) goto miss;
+
+	if ((e->expires < now) || (e->gen != cache_l1_generation(shared, key, key_len))) {
+		talloc_free(e);
+		goto miss;
+	}
+
+	fr_dlist_remove(&e->entry);
+	fr_dlist_insert_head(&l1->lru, &e->entry);
+
+	atomic_fetch_add_explicit(&shared->hits, 1, memory_order_relaxed);
+	return e->c;
+
+miss:
+	atomic_fetch_add_explicit(&shared->misses, 1, memory_order_relaxed);
+	return NULL;
+}
+
+/** Put an entry returned by the driver into the L1
+ *
+ * On success, the L1 takes the entry, and cache_free() leaves it alone.
+ *
+ * @param[in] l1	of this worker.
+ * @param[in] c		as returned by the driver's find() callback.
+ * @param[in] gen	of the key, from before the driver was asked.
+ * @param[in] now	the time of the request.
+ */
+void cache_l1_insert(cache_l1_t *l1, rlm_cache_entry_t *c, uint32_t gen, time_t now)
+{
+	rlm_cache_t const	*inst = l1->inst;
+	cache_l1_entry_t	my_e, *e;
+	fr_dlist_t		*tail;
+
+	my_e.key = c->key;
+	my_e.key_len = c->key_len;
+
+	e = rbtree_finddata(l1->tree, &my_e);
+	if (e) talloc_free(e);
+
+	while ((l1->count >= inst->config.l1_max_entries) && (tail = FR_DLIST_TAIL(l1->lru))) {
+		talloc_free(fr_ptr_to_type(cache_l1_entry_t, entry, tail));
+	}
+
+	e = talloc_zero(l1, cache_l1_entry_t);
+	if (!e) return;
+
+	e->l1 = l1;
+	e->key = c->key;
+	e->key_len = c->key_len;
+	e->c = c;
+	e->gen = gen;
+	e->expires = now + inst->config.l1_ttl;
+	if (c->expires < e->expires) e->expires = c->expires;
+
+	if (!rbtree_insert(l1->tree, e)) {
+		talloc_free(e);
+		return;
+	}
+
+	talloc_steal(e, c);
+	c->in_l1 = true;
+
+	fr_dlist_insert_head(&l1->lru, &e->entry);
+	l1->count++;
+
+	if (inst->config.memory) {
+		e->size = talloc_total_size(e);
+		fr_memory_add(inst->config.memory, e->size);
+	}
+
+	talloc_set_destructor(e, _cache_l1_entry_free);
+}
+
+/** Take an entry back from the L1
+ *
+ * Used when the entry must outlive the call to the module.  The caller
+ * owns the entry afterwards, and frees it with cache_free().
+ *
+ * @param[in] l1	of this worker.
+ * @param[in] c		as returned by cache_l1_find().
+ */
+void cache_l1_remove(cache_l1_t *l1, rlm_cache_entry_t *c)
+{
+	cache_l1_entry_t	my_e, *e;
+
+	my_e.key = c->key;
+	my_e.key_len = c->key_len;
+
+	e = rbtree_finddata(l1->tree, &my_e);
+	if (!e || (e->c != c)) return;
+
+	talloc_steal(NULL, c);
+	c->in_l1 = false;
+	e->c = NULL;
+
+	talloc_free(e);
+}
@@ -0,0 +1,50 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ * @file l1.h
+ * @brief A small cache in each worker, in front of the driver.
+ *
+ * @copyright 2026  The FreeRADIUS server project
+ */
+RCSIDH(l1_h, "$Id$")
+
+/*
+ *	Must be a power of 2.
+ */
+#define CACHE_L1_GENERATIONS	(4096)
+
+/** State shared by the L1 caches of all workers
+ *
+ * Each key hashes to a generation.  Writing an entry, or expiring
+ * it, bumps the generation of its key, and L1 entries filled under
+ * an older generation are dropped the next time they're found.
+ */
+struct cache_l1_shared {
+	atomic_ullong		hits;			//!< Lookups answered by an L1.
+	atomic_ullong		misses;			//!< Lookups which went to the driver.
+	atomic_uint		gen[CACHE_L1_GENERATIONS];
+};
+
+cache_l1_shared_t	*cache_l1_shared_alloc(TALLOC_CTX *ctx);
+uint32_t		cache_l1_generation(cache_l1_shared_t *shared, uint8_t const *key, size_t key_len);
+void			cache_l1_invalidate(cache_l1_shared_t *shared, uint8_t const *key, size_t key_len);
+
+cache_l1_t		*cache_l1_alloc(TALLOC_CTX *ctx, rlm_cache_t const *inst);
+rlm_cache_entry_t	*cache_l1_find(cache_l1_t *l1, uint8_t const *key, size_t key_len, time_t now);
+void			cache_l1_insert(cache_l1_t *l1, rlm_cache_entry_t *c, uint32_t gen, time_t now);
+void			cache_l1_remove(cache_l1_t *l1, rlm_cache_entry_t *c);
@@ -33,28 +33,74 @@ RCSID("$Id$")
 #include <freeradius-devel/rad_assert.h>
 
 #include "rlm_cache.h"
+#include "serialize.h"
+#include "snapshot.h"
+#include "l1.h"
 
 extern rad_module_t rlm_cache;
 
+static const CONF_PARSER l1_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_cache_config_t, l1_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("ttl", FR_TYPE_UINT32, rlm_cache_config_t, l1_ttl), .dflt = "5" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", FR_TYPE_STRING, rlm_cache_config_t, driver_name), .dflt = "rlm_cache_rbtree" },
 	{ FR_CONF_OFFSET("key", FR_TYPE_TMPL | FR_TYPE_REQUIRED, rlm_cache_config_t, key) },
 	{ FR_CONF_OFFSET("ttl", FR_TYPE_UINT32, rlm_cache_config_t, ttl), .dflt = "500" },
+	{ FR_CONF_OFFSET("stale_ttl", FR_TYPE_UINT32, rlm_cache_config_t, stale_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("coalesce_timeout", FR_TYPE_TIMEVAL, rlm_cache_config_t, coalesce_timeout), .dflt = "0" },
 	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_cache_config_t, max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("negative_ttl", FR_TYPE_UINT32, rlm_cache_config_t, negative_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("negative_max_entries", FR_TYPE_UINT32, rlm_cache_config_t, negative_max_entries), .dflt = "0" },
 
 	/* Should be a type which matches time_t, @fixme before 2038 */
+	{ FR_CONF_OFFSET("snapshot", FR_TYPE_FILE_OUTPUT, rlm_cache_config_t, snapshot) },
 	{ FR_CONF_OFFSET("epoch", FR_TYPE_INT32, rlm_cache_config_t, epoch), .dflt = "0" },
 	{ FR_CONF_OFFSET("add_stats", FR_TYPE_BOOL, rlm_cache_config_t, stats), .dflt = "no" },
+
+	{ FR_CONF_POINTER("l1", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) l1_config },
 	CONF_PARSER_TERMINATOR
 };
 
+/** What a call to the module is doing
+ *
+ * Kept so that a request can wait for another request to populate
+ * the entry, or for the driver, and pick up where it left off.
+ */
+typedef struct rlm_cache_op_t {
+	rlm_cache_t const	*inst;			//!< Instance of rlm_cache.
+	uint8_t const		*key;			//!< Key of the entry.
+	size_t			key_len;		//!< Length of key data.
+
+	bool			status_only;		//!< Only say whether the entry exists.
+	bool			merge;			//!< Merge an existing entry into the request.
+	bool			insert;			//!< Insert a new entry.
+	bool			expire;			//!< Expire an existing entry.
+	bool			set_ttl;		//!< Update the TTL of an existing entry.
+	bool			negative;		//!< Insert a negative entry.
+	int			ttl;			//!< For entries we insert or update.
+
+	bool			waited;			//!< Whether give_up has been set.
+	struct timeval		give_up;		//!< When to stop waiting for another request.
+
+	int			exists;			//!< Whether the entry exists, -1 if we don't know.
+	rlm_rcode_t		rcode;			//!< Result of the stages we've done.
+	rlm_cache_entry_t	*c;			//!< The entry we found, or are inserting.
+	bool			merged;			//!< Whether the new entry was merged into the request.
+} rlm_cache_op_t;
+
 /** Get exclusive use of a handle to access the cache
  *
+ * Drivers without an acquire callback get their thread instance data
+ * instead, if we're running in a worker.
  */
-static int cache_acquire(rlm_cache_handle_t **out, rlm_cache_t const *inst, REQUEST *request)
+static int cache_acquire(rlm_cache_handle_t **out, rlm_cache_t const *inst, rlm_cache_thread_t *t,
+			 REQUEST *request)
 {
 	if (!inst->driver->acquire) {
-		*out = NULL;
+		*out = t ? t->driver : NULL;
 		return 0;
 	}
 
@@ -108,13 +154,21 @@ static rlm_cache_entry_t *cache_alloc(rlm_cache_t const *inst, REQUEST *request)
  *
  * Some drivers (like rlm_cache_rbtree) don't register a free function.
  * This means that the cache entry never needs to be explicitly freed.
+ * Entries in an L1 are freed by the L1.
  *
  * @param[in] inst Module instance.
  * @param[in,out] c Cache entry to free.
  */
 static void cache_free(rlm_cache_t const *inst, rlm_cache_entry_t **c)
 {
-	if (!c || !*c || !inst->driver->free) return;
+	if (!c || !*c) return;
+
+	if ((*c)->in_l1) {
+		*c = NULL;
+		return;
+	}
+
+	if (!inst->driver->free) return;
 
 	inst->driver->free(*c);
 	*c = NULL;
@@ -173,20 +227,50 @@ static rlm_rcode_t cache_merge(rlm_cache_t const *inst, REQUEST *request, rlm_ca
 
 /** Find a cached entry.
  *
+ * The worker's L1 is checked first, if there is one.  Entries found
+ * by the driver are then put into the L1.
+ *
+ * If the driver yields, we're called again when the request resumes,
+ * and the driver hands over what it found.  The generation of the key
+ * is then read after the lookup, so a write which raced with it may go
+ * unnoticed by the L1 for up to "l1.ttl" seconds, as with writes from
+ * other servers.
+ *
+ * @param[out] out	the entry.
+ * @param[in] inst	Module instance.
+ * @param[in] t		thread instance, or NULL to always ask the driver.
+ * @param[in] request	The current request.
+ * @param[in] handle	from cache_acquire().
+ * @param[in] key	of the entry.
+ * @param[in] key_len	the length of the key.
  * @return
  *	- #RLM_MODULE_OK on cache hit.
  *	- #RLM_MODULE_FAIL on failure.
  *	- #RLM_MODULE_NOTFOUND on cache miss.
+ *	- #RLM_MODULE_YIELD if the driver yielded the request.
  */
-static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst, REQUEST *request,
-			      rlm_cache_handle_t **handle, uint8_t const *key, size_t key_len)
+static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst, rlm_cache_thread_t *t,
+			      REQUEST *request, rlm_cache_handle_t **handle, uint8_t const *key, size_t key_len)
 {
 	cache_status_t ret;
 
 	rlm_cache_entry_t *c;
+	uint32_t gen = 0;
 
 	*out = NULL;
 
+	if (t && t->l1) {
+		c = cache_l1_find(t->l1, key, key_len, request->packet->timestamp.tv_sec);
+		if (c && (c->created >= inst->config.epoch)) {
+			RDEBUG2("Found %sentry in this worker's cache", c->negative ? "negative " : "");
+			c->hits++;
+			*out = c;
+			return RLM_MODULE_OK;
+		}
+
+		gen = cache_l1_generation(inst->l1, key, key_len);
+	}
+
 	for (;;) {
 		ret = inst->driver->find(&c, &inst->config, inst->driver_inst->data, request, *handle, key, key_len);
 		switch (ret) {
@@ -208,6 +292,9 @@ static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst,
 			}
 			return RLM_MODULE_NOTFOUND;
 
+		case CACHE_YIELD:
+			return RLM_MODULE_YIELD;
+
 		/* FALL-THROUGH */
 		default:
 			return RLM_MODULE_FAIL;
@@ -231,7 +318,16 @@ static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst,
 			talloc_free(p);
 		}
 
-		inst->driver->expire(&inst->config, inst->driver_inst->data, request, handle, c->key, c->key_len);
+		/*
+		 *	If the driver yields, it reports a miss
+		 *	when we ask it again.
+		 */
+		if (inst->driver->expire(&inst->config, inst->driver_inst->data, request, *handle,
+					 c->key, c->key_len) == CACHE_YIELD) {
+			cache_free(inst, &c);
+			return RLM_MODULE_YIELD;
+		}
+		if (inst->l1) cache_l1_invalidate(inst->l1, key, key_len);
 		cache_free(inst, &c);
 		return RLM_MODULE_NOTFOUND;	/* Couldn't find a non-expired entry */
 	}
@@ -240,11 +336,12 @@ static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst,
 		char *p;
 
 		p = fr_asprint(request, (char const *)key, key_len, '"');
-		RDEBUG2("Found entry for \"%s\"", p);
+		RDEBUG2("Found %sentry for \"%s\"", c->negative ? "negative " : "", p);
 		talloc_free(p);
 	}
 
 	c->hits++;
+	if (t && t->l1) cache_l1_insert(t->l1, c, gen, request->packet->timestamp.tv_sec);
 	*out = c;
 
 	return RLM_MODULE_OK;
@@ -256,37 +353,90 @@ static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst,
  *	- #RLM_MODULE_OK on success.
  *	- #RLM_MODULE_NOTFOUND if no entry existed.
  *	- #RLM_MODULE_FAIL on failure.
+ *	- #RLM_MODULE_YIELD if the driver yielded the request.
  */
 static rlm_rcode_t cache_expire(rlm_cache_t const *inst, REQUEST *request,
 				rlm_cache_handle_t **handle, uint8_t const *key, size_t key_len)
 {
+	cache_status_t ret;
+
 	RDEBUG("Expiring cache entry");
-	for (;;) switch (inst->driver->expire(&inst->config, inst->driver_inst->data, request,
-					      *handle, key, key_len)) {
-	case CACHE_RECONNECT:
-		if (cache_reconnect(handle, inst, request) == 0) continue;
+	for (;;) {
+		ret = inst->driver->expire(&inst->config, inst->driver_inst->data, request, *handle, key, key_len);
+		if ((ret != CACHE_RECONNECT) || (cache_reconnect(handle, inst, request) < 0)) break;
+	}
+	if (ret == CACHE_YIELD) return RLM_MODULE_YIELD;
 
-	/* FALL-THROUGH */
-	default:
-		return RLM_MODULE_FAIL;
+	if (inst->l1) cache_l1_invalidate(inst->l1, key, key_len);
 
+	switch (ret) {
 	case CACHE_OK:
 		return RLM_MODULE_OK;
 
 	case CACHE_MISS:
 		return RLM_MODULE_NOTFOUND;
+
+	default:
+		return RLM_MODULE_FAIL;
+	}
+}
+
+/** Reserve space for a negative entry
+ *
+ * The budget is kept locally, as a ring of the expiry times of the
+ * negative entries this instance inserted.  Entries almost always
+ * expire in the order they were inserted, so only the oldest ones
+ * are checked.  An entry which outlives a younger one (because
+ * Cache-TTL was set) only delays the younger one's space being
+ * reclaimed.
+ *
+ * @return
+ *	- true if the entry may be inserted.
+ *	- false if the budget has been used up.
+ */
+static bool cache_negative_reserve(rlm_cache_t const *inst, REQUEST *request, time_t expires)
+{
+	rlm_cache_t	*mutable;
+	uint32_t	max = inst->config.negative_max_entries;
+	bool		ret = false;
+
+	if (!inst->negative) return true;
+
+	memcpy(&mutable, &inst, sizeof(mutable));
+
+	pthread_mutex_lock(&mutable->negative_mutex);
+	while (mutable->negative_count &&
+	       (mutable->negative[mutable->negative_head] < request->packet->timestamp.tv_sec)) {
+		mutable->negative_head = (mutable->negative_head + 1) % max;
+		mutable->negative_count--;
+	}
+
+	if (mutable->negative_count < max) {
+		mutable->negative[(mutable->negative_head + mutable->negative_count) % max] = expires;
+		mutable->negative_count++;
+		ret = true;
 	}
+	pthread_mutex_unlock(&mutable->negative_mutex);
+
+	return ret;
 }
 
 /** Create and insert a cache entry
+ *
+ * Negative entries record that there's nothing to cache for the key,
+ * so they have no maps, and are never merged.
+ *
+ * If the driver yields, the new entry is kept in the op, and is
+ * inserted without being built again when we're called back.
  *
  * @return
  *	- #RLM_MODULE_OK on success.
  *	- #RLM_MODULE_UPDATED if we merged the cache entry.
  *	- #RLM_MODULE_FAIL on failure.
+ *	- #RLM_MODULE_YIELD if the driver yielded the request.
  */
 static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_cache_handle_t **handle,
-				uint8_t const *key, size_t key_len, int ttl)
+				rlm_cache_op_t *op)
 {
 	vp_map_t		const *map;
 	vp_map_t		**last, *c_map;
@@ -298,19 +448,42 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 
 	TALLOC_CTX		*pool;
 
+	uint8_t const		*key = op->key;
+	size_t			key_len = op->key_len;
+	int			ttl = op->ttl;
+	bool			negative = op->negative;
+
+	if (op->c) {
+		c = op->c;
+		merge = op->merged;
+		goto insert;
+	}
+
 	if ((inst->config.max_entries > 0) && inst->driver->count &&
-	    (inst->driver->count(&inst->config, inst->driver_inst->data, request, handle) > inst->config.max_entries)) {
+	    (inst->driver->count(&inst->config, inst->driver_inst->data, request, *handle) > inst->config.max_entries)) {
 		RWDEBUG("Cache is full: %d entries", inst->config.max_entries);
 		return RLM_MODULE_FAIL;
 	}
 
+	if (negative && !cache_negative_reserve(inst, request,
+						request->packet->timestamp.tv_sec + ttl + inst->config.stale_ttl)) {
+		RWDEBUG("Too many negative entries: %d entries", inst->config.negative_max_entries);
+		return RLM_MODULE_FAIL;
+	}
+
 	c = cache_alloc(inst, request);
 	if (!c) return RLM_MODULE_FAIL;
 
 	c->key = talloc_memdup(c, key, key_len);
 	c->key_len = key_len;
 	c->created = c->expires = request->packet->timestamp.tv_sec;
-	c->expires += ttl;
+	c->expires += ttl + inst->config.stale_ttl;
+
+	if (negative) {
+		RDEBUG("Creating new negative cache entry");
+		c->negative = true;
+		goto insert;
+	}
 
 	last = &c->maps;
 
@@ -348,6 +521,7 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 			case FR_CACHE_STATUS_ONLY:
 			case FR_CACHE_MERGE_NEW:
 			case FR_CACHE_ENTRY_HITS:
+			case FR_CACHE_NEGATIVE:
 				RDEBUG2("Skipping %s", vp->da->name);
 				continue;
 
@@ -438,6 +612,7 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 
 	if (merge) cache_merge(inst, request, c);
 
+insert:
 	for (;;) {
 		cache_status_t ret;
 
@@ -445,16 +620,26 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 		switch (ret) {
 		case CACHE_RECONNECT:
 			if (cache_reconnect(handle, inst, request) == 0) continue;
+			talloc_free(c);
+			op->c = NULL;
 			return RLM_MODULE_FAIL;
 
+		case CACHE_YIELD:
+			op->c = c;
+			op->merged = merge;
+			return RLM_MODULE_YIELD;
+
 		case CACHE_OK:
 			RDEBUG("Committed entry, TTL %d seconds", ttl);
+			if (inst->l1) cache_l1_invalidate(inst->l1, key, key_len);
 			cache_free(inst, &c);
+			op->c = NULL;
 			return merge ? RLM_MODULE_UPDATED :
 				       RLM_MODULE_OK;
 
 		default:
 			talloc_free(c);	/* Failed insertion - use talloc_free not the driver free */
+			op->c = NULL;
 			return RLM_MODULE_FAIL;
 		}
 	}
@@ -465,6 +650,7 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
  * @return
  *	- #RLM_MODULE_OK on success.
  *	- #RLM_MODULE_FAIL on failure.
+ *	- #RLM_MODULE_YIELD if the driver yielded the request.
  */
 static rlm_rcode_t cache_set_ttl(rlm_cache_t const *inst, REQUEST *request,
 				 rlm_cache_handle_t **handle, rlm_cache_entry_t *c)
@@ -481,8 +667,12 @@ static rlm_rcode_t cache_set_ttl(rlm_cache_t const *inst, REQUEST *request,
 			if (cache_reconnect(handle, inst, request) == 0) continue;
 			return RLM_MODULE_FAIL;
 
+		case CACHE_YIELD:
+			return RLM_MODULE_YIELD;
+
 		case CACHE_OK:
 			RDEBUG("Updated entry TTL");
+			if (inst->l1) cache_l1_invalidate(inst->l1, c->key, c->key_len);
 			return RLM_MODULE_OK;
 
 		default:
@@ -503,8 +693,12 @@ static rlm_rcode_t cache_set_ttl(rlm_cache_t const *inst, REQUEST *request,
 			if (cache_reconnect(handle, inst, request) == 0) continue;
 			return RLM_MODULE_FAIL;
 
+		case CACHE_YIELD:
+			return RLM_MODULE_YIELD;
+
 		case CACHE_OK:
 			RDEBUG("Updated entry TTL");
+			if (inst->l1) cache_l1_invalidate(inst->l1, c->key, c->key_len);
 			return RLM_MODULE_OK;
 
 		default:
@@ -529,6 +723,283 @@ static int cache_verify(vp_map_t *map, void *ctx)
 	return 0;
 }
 
+/** A request which is populating an entry
+ *
+ * Other requests which miss on the same key wait for the entry to
+ * appear instead of hitting the backend themselves.  If the entry is
+ * stale, they use it while the owner of the claim refreshes it.
+ *
+ * Claims are allocated in the ctx of the owning request, so they go
+ * away if the request finishes without inserting an entry.
+ */
+typedef struct rlm_cache_claim_t {
+	rlm_cache_t		*inst;			//!< Whose claims tree we're in.
+	REQUEST			*request;		//!< Populating the entry.
+	uint8_t const		*key;			//!< Key of the entry.
+	size_t			key_len;		//!< Length of key data.
+} rlm_cache_claim_t;
+
+/** How often a waiting request checks whether its entry has appeared
+ *
+ * The request populating the entry may be running in another thread,
+ * so it can't mark the waiters as resumable.
+ */
+#define CACHE_COALESCE_POLL	(10000)
+
+static int cache_claim_cmp(void const *one, void const *two)
+{
+	rlm_cache_claim_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+static int _cache_claim_free(rlm_cache_claim_t *claim)
+{
+	pthread_mutex_lock(&claim->inst->claims_mutex);
+	rbtree_deletebydata(claim->inst->claims, claim);
+	pthread_mutex_unlock(&claim->inst->claims_mutex);
+
+	return 0;
+}
+
+/** Claim the right to populate an entry
+ *
+ * @return
+ *	- true if this request holds the claim.
+ *	- false if another request does.
+ */
+static bool cache_claim(rlm_cache_t const *inst, REQUEST *request, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_claim_t	my_claim, *claim;
+	rlm_cache_t		*mutable;
+	bool			ret = true;
+
+	if (!inst->claims) return true;
+
+	memcpy(&mutable, &inst, sizeof(mutable));
+
+	my_claim.key = key;
+	my_claim.key_len = key_len;
+
+	pthread_mutex_lock(&mutable->claims_mutex);
+	claim = rbtree_finddata(inst->claims, &my_claim);
+	if (claim) {
+		ret = (claim->request == request);
+		goto finish;
+	}
+
+	MEM(claim = talloc_zero(request, rlm_cache_claim_t));
+	claim->inst = mutable;
+	claim->request = request;
+	claim->key = talloc_memdup(claim, key, key_len);
+	claim->key_len = key_len;
+
+	if (!rbtree_insert(inst->claims, claim)) {
+		talloc_free(claim);
+		goto finish;
+	}
+	talloc_set_destructor(claim, _cache_claim_free);
+
+	RDEBUG3("Claimed entry");
+
+finish:
+	pthread_mutex_unlock(&mutable->claims_mutex);
+
+	return ret;
+}
+
+/** Give up a claim, once the entry has been populated
+ *
+ */
+static void cache_claim_release(rlm_cache_t const *inst, REQUEST *request, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_claim_t	my_claim, *claim;
+	rlm_cache_t		*mutable;
+
+	if (!inst->claims) return;
+
+	memcpy(&mutable, &inst, sizeof(mutable));
+
+	my_claim.key = key;
+	my_claim.key_len = key_len;
+
+	pthread_mutex_lock(&mutable->claims_mutex);
+	claim = rbtree_finddata(inst->claims, &my_claim);
+	if (claim && (claim->request != request)) claim = NULL;
+	pthread_mutex_unlock(&mutable->claims_mutex);
+
+	/*
+	 *	Only the owner frees the claim, so it can't
+	 *	disappear between the unlock and here.
+	 */
+	if (claim) {
+		RDEBUG3("Released claim on entry");
+		talloc_free(claim);
+	}
+}
+
+/** Remove the cache control attributes from the request
+ *
+ */
+static void cache_control_clear(REQUEST *request)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+
+	for (vp = fr_pair_cursor_init(&cursor, &request->control);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		if (vp->da->vendor == 0) switch (vp->da->attr) {
+		case FR_CACHE_TTL:
+		case FR_CACHE_STATUS_ONLY:
+		case FR_CACHE_ALLOW_MERGE:
+		case FR_CACHE_ALLOW_INSERT:
+		case FR_CACHE_MERGE_NEW:
+		case FR_CACHE_NEGATIVE:
+			RDEBUG2("Removing &control:%s", vp->da->name);
+			vp = fr_pair_cursor_remove(&cursor);
+			talloc_free(vp);
+			break;
+		}
+	}
+}
+
+static rlm_rcode_t cache_op(rlm_cache_t const *inst, rlm_cache_thread_t *t, REQUEST *request,
+			    rlm_cache_op_t *op);
+
+/** Free the entry held by a yielded op, if the request goes away before it resumes
+ *
+ */
+static int _cache_op_free(rlm_cache_op_t *op)
+{
+	cache_free(op->inst, &op->c);
+
+	return 0;
+}
+
+/** Pick up where we left off
+ *
+ * Either another request has had a chance to populate the entry,
+ * or the driver has an answer for us.
+ */
+static rlm_rcode_t mod_cache_resume(REQUEST *request, void *instance, void *thread, void *ctx)
+{
+	rlm_cache_op_t	*op = talloc_get_type_abort(ctx, rlm_cache_op_t);
+	rlm_rcode_t	rcode;
+
+	rcode = cache_op(instance, thread, request, op);
+	talloc_free(op);
+
+	return rcode;
+}
+
+/** Tell the driver to stop waiting, if the request is done before it resumes
+ *
+ */
+static void mod_cache_signal(REQUEST *request, void *instance, UNUSED void *thread, UNUSED void *ctx,
+			     fr_state_action_t action)
+{
+	rlm_cache_t const *inst = instance;
+
+	if (action != FR_ACTION_DONE) return;
+
+	inst->driver->cancel(&inst->config, inst->driver_inst->data, request);
+}
+
+static void cache_wait_done(REQUEST *request, UNUSED void *instance, UNUSED void *thread, UNUSED void *ctx,
+			    UNUSED struct timeval *fired)
+{
+	unlang_resumable(request);
+}
+
+/** Wait for another request to populate an entry
+ *
+ * @return
+ *	- #RLM_MODULE_YIELD if the request is waiting.
+ *	- #RLM_MODULE_NOTFOUND if it has waited long enough.
+ *	- #RLM_MODULE_FAIL on error.
+ */
+static rlm_rcode_t cache_wait(rlm_cache_t const *inst, REQUEST *request, rlm_cache_op_t const *op)
+{
+	rlm_cache_op_t	*wait;
+	struct timeval	now, when;
+
+	gettimeofday(&now, NULL);
+
+	if (op->waited && (fr_timeval_cmp(&now, &op->give_up) >= 0)) {
+		RWDEBUG("Gave up waiting for another request to populate the entry");
+		return RLM_MODULE_NOTFOUND;
+	}
+
+	MEM(wait = talloc(request, rlm_cache_op_t));
+	*wait = *op;
+	wait->key = talloc_memdup(wait, op->key, op->key_len);
+	if (!wait->waited) {
+		fr_timeval_add(&wait->give_up, &now, &inst->config.coalesce_timeout);
+		wait->waited = true;
+	}
+
+	when.tv_sec = 0;
+	when.tv_usec = CACHE_COALESCE_POLL;
+	fr_timeval_add(&when, &now, &when);
+	if (fr_timeval_cmp(&when, &wait->give_up) > 0) when = wait->give_up;
+
+	if (unlang_event_timeout_add(request, cache_wait_done, wait, &when) < 0) {
+		talloc_free(wait);
+		return RLM_MODULE_FAIL;
+	}
+
+	RDEBUG2("Waiting for another request to populate the entry");
+
+	/*
+	 *	Other requests may run before we resume, and
+	 *	our flags are in the op now.
+	 */
+	cache_control_clear(request);
+
+	return unlang_module_yield(request, mod_cache_resume, NULL, wait);
+}
+
+/** Wait for the driver to answer
+ *
+ * The driver marks the request resumable once its datastore has
+ * answered.  We then run the op again, and the driver hands over
+ * the result.
+ *
+ * @return #RLM_MODULE_YIELD.
+ */
+static rlm_rcode_t cache_yield(rlm_cache_t const *inst, rlm_cache_thread_t *t, REQUEST *request,
+			       rlm_cache_handle_t **handle, rlm_cache_op_t *op)
+{
+	rlm_cache_op_t	*yielded;
+
+	rad_assert(inst->driver->cancel);
+
+	cache_release(inst, request, handle);
+
+	MEM(yielded = talloc(request, rlm_cache_op_t));
+	*yielded = *op;
+	yielded->key = talloc_memdup(yielded, op->key, op->key_len);
+
+	/*
+	 *	Other requests may push the entry out of
+	 *	the L1 before we resume.
+	 */
+	if (yielded->c && yielded->c->in_l1) cache_l1_remove(t->l1, yielded->c);
+	op->c = NULL;
+	talloc_set_destructor(yielded, _cache_op_free);
+
+	RDEBUG3("Waiting for the driver");
+
+	cache_control_clear(request);
+
+	return unlang_module_yield(request, mod_cache_resume, mod_cache_signal, yielded);
+}
+
 /** Do caching checks
  *
  * Since we can update ANY VP list, we do exactly the same thing for all sections
@@ -537,26 +1008,26 @@ static int cache_verify(vp_map_t *map, void *ctx)
  * If you want to cache something different in different sections, configure
  * another cache module.
  */
-static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_cache_it(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_cache_it(void *instance, void *thread, REQUEST *request)
 {
-	rlm_cache_entry_t	*c = NULL;
 	rlm_cache_t const	*inst = instance;
+	rlm_cache_thread_t	*t = thread;
 
-	rlm_cache_handle_t	*handle;
-
-	vp_cursor_t		cursor;
 	VALUE_PAIR		*vp;
 
-	bool			merge = true, insert = true, expire = false, set_ttl = false;
-	int			exists = -1;
-
 	uint8_t			buffer[1024];
 	uint8_t const		*key;
 	ssize_t			key_len;
-	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
 
-	int			ttl = inst->config.ttl;
+	rlm_cache_op_t		op = {
+					.inst = inst,
+					.merge = true,
+					.insert = true,
+					.ttl = inst->config.ttl,
+					.exists = -1,
+					.rcode = RLM_MODULE_NOOP
+				};
 
 	key_len = tmpl_expand((char const **)&key, (char *)buffer, sizeof(buffer),
 			      request, inst->config.key, NULL, NULL);
@@ -567,6 +1038,9 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 		return RLM_MODULE_INVALID;
 	}
 
+	op.key = key;
+	op.key_len = key_len;
+
 	/*
 	 *	If Cache-Status-Only == yes, only return whether we found a
 	 *	valid cache entry
@@ -577,66 +1051,149 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 		RDEBUG3("status-only: yes");
 		REXDENT();
 
-		if (cache_acquire(&handle, inst, request) < 0) return RLM_MODULE_FAIL;
-
-		rcode = cache_find(&c, inst, request, &handle, key, key_len);
-		if (rcode == RLM_MODULE_FAIL) goto finish;
-		rad_assert(!inst->driver->acquire || handle);
+		op.status_only = true;
 
-		rcode = c ? RLM_MODULE_OK:
-			    RLM_MODULE_NOTFOUND;
-		goto finish;
+		return cache_op(inst, t, request, &op);
 	}
 
 	/*
 	 *	Figure out what operation we're doing
 	 */
 	vp = fr_pair_find_by_num(request->control, 0, FR_CACHE_ALLOW_MERGE, TAG_ANY);
-	if (vp) merge = (bool)vp->vp_uint32;
+	if (vp) op.merge = (bool)vp->vp_uint32;
 
 	vp = fr_pair_find_by_num(request->control, 0, FR_CACHE_ALLOW_INSERT, TAG_ANY);
-	if (vp) insert = (bool)vp->vp_uint32;
+	if (vp) op.insert = (bool)vp->vp_uint32;
+
+	vp = fr_pair_find_by_num(request->control, 0, FR_CACHE_NEGATIVE, TAG_ANY);
+	if (vp && vp->vp_uint32) {
+		op.negative = true;
+		if (inst->config.negative_ttl) op.ttl = inst->config.negative_ttl;
+	}
 
 	vp = fr_pair_find_by_num(request->control, 0, FR_CACHE_TTL, TAG_ANY);
 	if (vp) {
 		if (vp->vp_int32 == 0) {
-			expire = true;
+			op.expire = true;
 		} else if (vp->vp_int32 < 0) {
-			expire = true;
-			ttl = -(vp->vp_int32);
+			op.expire = true;
+			op.ttl = -(vp->vp_int32);
 		/* Updating the TTL */
 		} else {
-			set_ttl = true;
-			ttl = vp->vp_int32;
+			op.set_ttl = true;
+			op.ttl = vp->vp_int32;
 		}
 	}
 
 	RINDENT();
-	RDEBUG3("merge  : %s", merge ? "yes" : "no");
-	RDEBUG3("insert : %s", insert ? "yes" : "no");
-	RDEBUG3("expire : %s", expire ? "yes" : "no");
-	RDEBUG3("ttl    : %i", ttl);
+	RDEBUG3("merge    : %s", op.merge ? "yes" : "no");
+	RDEBUG3("insert   : %s", op.insert ? "yes" : "no");
+	RDEBUG3("expire   : %s", op.expire ? "yes" : "no");
+	RDEBUG3("negative : %s", op.negative ? "yes" : "no");
+	RDEBUG3("ttl      : %i", op.ttl);
 	REXDENT();
-	if (cache_acquire(&handle, inst, request) < 0) return RLM_MODULE_FAIL;
+
+	return cache_op(inst, t, request, &op);
+}
+
+/** Merge, insert, expire or update the TTL of an entry
+ *
+ * If the driver yields, we're called again with a copy of the op when
+ * the request resumes.  The stages which have already run recorded
+ * whether the entry exists, so they're skipped, and the stage which
+ * yielded gets its result from the driver.
+ */
+static rlm_rcode_t cache_op(rlm_cache_t const *inst, rlm_cache_thread_t *t, REQUEST *request,
+			    rlm_cache_op_t *op)
+{
+	rlm_cache_handle_t	*handle;
+
+	uint8_t const		*key = op->key;
+	size_t			key_len = op->key_len;
+	rlm_rcode_t		rcode;
+
+	if (cache_acquire(&handle, inst, t, request) < 0) return RLM_MODULE_FAIL;
+
+	if (op->status_only) {
+		switch (cache_find(&op->c, inst, t, request, &handle, key, key_len)) {
+		case RLM_MODULE_YIELD:
+			return cache_yield(inst, t, request, &handle, op);
+
+		case RLM_MODULE_OK:
+			op->rcode = op->c->negative ? RLM_MODULE_NOOP :
+						      RLM_MODULE_OK;
+			break;
+
+		case RLM_MODULE_NOTFOUND:
+			op->rcode = RLM_MODULE_NOTFOUND;
+			break;
+
+		default:
+			op->rcode = RLM_MODULE_FAIL;
+			break;
+		}
+		goto finish;
+	}
 
 	/*
 	 *	Retrieve the cache entry and merge it with the current request
 	 *	recording whether the entry existed.
 	 */
-	if (merge) {
-		rcode = cache_find(&c, inst, request, &handle, key, key_len);
+	if (op->merge && (op->exists < 0)) {
+		rcode = cache_find(&op->c, inst, t, request, &handle, key, key_len);
 		switch (rcode) {
+		case RLM_MODULE_YIELD:
+			return cache_yield(inst, t, request, &handle, op);
+
 		case RLM_MODULE_FAIL:
+			op->rcode = RLM_MODULE_FAIL;
 			goto finish;
 
 		case RLM_MODULE_OK:
-			rcode = cache_merge(inst, request, c);
-			exists = 1;
+			/*
+			 *	Past its TTL, but still within stale_ttl.
+			 *	One request refreshes it, everyone else
+			 *	carries on using it.
+			 */
+			if ((op->c->expires - (time_t)inst->config.stale_ttl) < request->packet->timestamp.tv_sec) {
+				if (cache_claim(inst, request, key, key_len)) {
+					RDEBUG2("Entry is stale, refreshing it");
+					cache_free(inst, &op->c);
+					op->rcode = RLM_MODULE_NOTFOUND;
+					op->exists = 0;
+					break;
+				}
+				RDEBUG2("Entry is stale, using it while another request refreshes it");
+			}
+
+			/*
+			 *	We already know there's nothing to
+			 *	find, don't make the caller look again.
+			 */
+			if (op->c->negative) {
+				op->rcode = RLM_MODULE_NOOP;
+				op->exists = 1;
+				break;
+			}
+			op->rcode = cache_merge(inst, request, op->c);
+			op->exists = 1;
 			break;
 
 		case RLM_MODULE_NOTFOUND:
-			rcode = RLM_MODULE_NOTFOUND;
-			exists = 0;
+			/*
+			 *	Someone else is already populating
+			 *	the entry, so wait for them.
+			 */
+			if (timerisset(&inst->config.coalesce_timeout) && !cache_claim(inst, request, key, key_len)) {
+				cache_release(inst, request, &handle);
+
+				rcode = cache_wait(inst, request, op);
+				if (rcode != RLM_MODULE_NOTFOUND) return rcode;
+
+				if (cache_acquire(&handle, inst, t, request) < 0) return RLM_MODULE_FAIL;
+			}
+			op->rcode = RLM_MODULE_NOTFOUND;
+			op->exists = 0;
 			break;
 
 		default:
@@ -652,20 +1209,23 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 	 *	We only expire if we're not inserting, as driver insert methods
 	 *	should perform upserts.
 	 */
-	if (expire && ((exists == -1) || (exists == 1))) {
-		if (!insert) {
-			rad_assert(!set_ttl);
+	if (op->expire && ((op->exists == -1) || (op->exists == 1))) {
+		if (!op->insert) {
+			rad_assert(!op->set_ttl);
 			switch (cache_expire(inst, request, &handle, key, key_len)) {
+			case RLM_MODULE_YIELD:
+				return cache_yield(inst, t, request, &handle, op);
+
 			case RLM_MODULE_FAIL:
-				rcode = RLM_MODULE_FAIL;
+				op->rcode = RLM_MODULE_FAIL;
 				goto finish;
 
 			case RLM_MODULE_OK:
-				if (rcode == RLM_MODULE_NOOP) rcode = RLM_MODULE_OK;
+				if (op->rcode == RLM_MODULE_NOOP) op->rcode = RLM_MODULE_OK;
 				break;
 
 			case RLM_MODULE_NOTFOUND:
-				if (rcode == RLM_MODULE_NOOP) rcode = RLM_MODULE_NOTFOUND;
+				if (op->rcode == RLM_MODULE_NOOP) op->rcode = RLM_MODULE_NOTFOUND;
 				break;
 
 			default:
@@ -675,7 +1235,8 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 			/* If it previously existed, it doesn't now */
 		}
 		/* Otherwise use insert to overwrite */
-		exists = 0;
+		cache_free(inst, &op->c);
+		op->exists = 0;
 	}
 
 	/*
@@ -683,19 +1244,22 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 	 *	and we need to do an insert or set_ttl operation
 	 *	determine that now.
 	 */
-	if ((exists < 0) && (insert || set_ttl)) {
-		switch (cache_find(&c, inst, request, &handle, key, key_len)) {
+	if ((op->exists < 0) && (op->insert || op->set_ttl)) {
+		switch (cache_find(&op->c, inst, t, request, &handle, key, key_len)) {
+		case RLM_MODULE_YIELD:
+			return cache_yield(inst, t, request, &handle, op);
+
 		case RLM_MODULE_FAIL:
-			rcode = RLM_MODULE_FAIL;
+			op->rcode = RLM_MODULE_FAIL;
 			goto finish;
 
 		case RLM_MODULE_OK:
-			exists = 1;
-			if (rcode != RLM_MODULE_UPDATED) rcode = RLM_MODULE_OK;
+			op->exists = 1;
+			if (op->rcode != RLM_MODULE_UPDATED) op->rcode = RLM_MODULE_OK;
 			break;
 
 		case RLM_MODULE_NOTFOUND:
-			exists = 0;
+			op->exists = 0;
 			break;
 
 		default:
@@ -707,19 +1271,22 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 	/*
 	 *	We can only alter the TTL on an entry if it exists.
 	 */
-	if (set_ttl && (exists == 1)) {
-		rad_assert(c);
+	if (op->set_ttl && (op->exists == 1)) {
+		rad_assert(op->c);
+
+		op->c->expires = request->packet->timestamp.tv_sec + op->ttl + inst->config.stale_ttl;
 
-		c->expires = request->packet->timestamp.tv_sec + ttl;
+		switch (cache_set_ttl(inst, request, &handle, op->c)) {
+		case RLM_MODULE_YIELD:
+			return cache_yield(inst, t, request, &handle, op);
 
-		switch (cache_set_ttl(inst, request, &handle, c)) {
 		case RLM_MODULE_FAIL:
-			rcode = RLM_MODULE_FAIL;
+			op->rcode = RLM_MODULE_FAIL;
 			goto finish;
 
 		case RLM_MODULE_NOTFOUND:
 		case RLM_MODULE_OK:
-			if (rcode != RLM_MODULE_UPDATED) rcode = RLM_MODULE_OK;
+			if (op->rcode != RLM_MODULE_UPDATED) op->rcode = RLM_MODULE_OK;
 			goto finish;
 
 		default:
@@ -733,18 +1300,23 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 	 *	setting the TTL, which precludes performing an
 	 *	insert.
 	 */
-	if (insert && (exists == 0)) {
-		switch (cache_insert(inst, request, &handle, key, key_len, ttl)) {
+	if (op->insert && (op->exists == 0)) {
+		rcode = cache_insert(inst, request, &handle, op);
+		if (rcode == RLM_MODULE_YIELD) return cache_yield(inst, t, request, &handle, op);
+
+		cache_claim_release(inst, request, key, key_len);
+
+		switch (rcode) {
 		case RLM_MODULE_FAIL:
-			rcode = RLM_MODULE_FAIL;
+			op->rcode = RLM_MODULE_FAIL;
 			goto finish;
 
 		case RLM_MODULE_OK:
-			if (rcode != RLM_MODULE_UPDATED) rcode = RLM_MODULE_OK;
+			if (op->rcode != RLM_MODULE_UPDATED) op->rcode = RLM_MODULE_OK;
 			break;
 
 		case RLM_MODULE_UPDATED:
-			rcode = RLM_MODULE_UPDATED;
+			op->rcode = RLM_MODULE_UPDATED;
 			break;
 
 		default:
@@ -756,29 +1328,11 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 
 
 finish:
-	cache_free(inst, &c);
+	cache_free(inst, &op->c);
 	cache_release(inst, request, &handle);
+	cache_control_clear(request);
 
-	/*
-	 *	Clear control attributes
-	 */
-	for (vp = fr_pair_cursor_init(&cursor, &request->control);
-	     vp;
-	     vp = fr_pair_cursor_next(&cursor)) {
-		if (vp->da->vendor == 0) switch (vp->da->attr) {
-		case FR_CACHE_TTL:
-		case FR_CACHE_STATUS_ONLY:
-		case FR_CACHE_ALLOW_MERGE:
-		case FR_CACHE_ALLOW_INSERT:
-		case FR_CACHE_MERGE_NEW:
-			RDEBUG2("Removing &control:%s", vp->da->name);
-			vp = fr_pair_cursor_remove(&cursor);
-			talloc_free(vp);
-			break;
-		}
-	}
-
-	return rcode;
+	return op->rcode;
 }
 
 /** Allow single attribute values to be retrieved from the cache
@@ -815,19 +1369,22 @@ static ssize_t cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
 		return -1;
 	}
 
-	if (cache_acquire(&handle, mod_inst, request) < 0) {
+	if (cache_acquire(&handle, mod_inst, NULL, request) < 0) {
 		talloc_free(target);
 		return -1;
 	}
 
-	switch (cache_find(&c, mod_inst, request, handle, key, key_len)) {
+	switch (cache_find(&c, mod_inst, NULL, request, &handle, key, key_len)) {
 	case RLM_MODULE_OK:		/* found */
 		break;
 
 	case RLM_MODULE_NOTFOUND:	/* not found */
+		cache_release(mod_inst, request, &handle);
+		talloc_free(target);
 		return 0;
 
 	default:
+		cache_release(mod_inst, request, &handle);
 		talloc_free(target);
 		return -1;
 	}
@@ -844,17 +1401,240 @@ static ssize_t cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
 
 	talloc_free(target);
 
+	cache_free(mod_inst, &c);
+	cache_release(mod_inst, request, &handle);
+
 	/*
 	 *	Check if we found a matching map
 	 */
 	if (!map) return 0;
 
-	cache_free(mod_inst, &c);
-	cache_release(mod_inst, request, &handle);
+	return ret;
+}
+
+/** Return one of the driver's counters
+ *
+ * Example:
+@verbatim
+"%{cache_stats:hits}" == 12
+@endverbatim
+ *
+ * The counters are hits, misses, evictions, rejected, entries and memory.
+ * If the workers have L1 caches, l1_hits and l1_misses count the
+ * lookups they answered, and the ones which went to the driver.
+ */
+static ssize_t cache_stats_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
+				void const *mod_inst, UNUSED void const *xlat_inst,
+				REQUEST *request, char const *fmt)
+{
+	rlm_cache_t const	*inst = mod_inst;
+	rlm_cache_stats_t	stats;
+	uint64_t		value;
+
+	while (isspace((int) *fmt)) fmt++;
+
+	if (inst->l1 && (strcmp(fmt, "l1_hits") == 0)) {
+		value = atomic_load_explicit(&inst->l1->hits, memory_order_relaxed);
+		goto done;
+	}
+
+	if (inst->l1 && (strcmp(fmt, "l1_misses") == 0)) {
+		value = atomic_load_explicit(&inst->l1->misses, memory_order_relaxed);
+		goto done;
+	}
+
+	if (!inst->driver->stats) {
+		REDEBUG("Driver %s doesn't provide statistics", inst->driver->name);
+		return -1;
+	}
+
+	memset(&stats, 0, sizeof(stats));
+	inst->driver->stats(&stats, &inst->config, inst->driver_inst->data);
+
+	if (strcmp(fmt, "hits") == 0) {
+		value = stats.hits;
+	} else if (strcmp(fmt, "misses") == 0) {
+		value = stats.misses;
+	} else if (strcmp(fmt, "evictions") == 0) {
+		value = stats.evictions;
+	} else if (strcmp(fmt, "rejected") == 0) {
+		value = stats.rejected;
+	} else if (strcmp(fmt, "entries") == 0) {
+		value = stats.entries;
+	} else if (strcmp(fmt, "memory") == 0) {
+		value = stats.memory;
+	} else {
+		REDEBUG("Unknown cache statistic \"%s\"", fmt);
+		return -1;
+	}
+
+done:
+	*out = talloc_typed_asprintf(ctx, "%" PRIu64, value);
+	return talloc_array_length(*out) - 1;
+}
+
+/** Write the entries in the cache to the snapshot file
+ *
+ * @return
+ *	- The number of entries written.
+ *	- -1 on error.
+ */
+static int cache_snapshot_write(rlm_cache_t const *inst)
+{
+	rlm_cache_t		*mutable;
+	cache_snapshot_t	*snap;
+	int			ret;
+
+	memcpy(&mutable, &inst, sizeof(mutable));
+
+	if (pthread_mutex_trylock(&mutable->snapshot_mutex) != 0) {
+		fr_strerror_printf("Another snapshot is being written");
+		return -1;
+	}
+
+	snap = cache_snapshot_open(NULL, inst->config.snapshot);
+	if (!snap) {
+		pthread_mutex_unlock(&mutable->snapshot_mutex);
+		return -1;
+	}
+
+	if (inst->driver->walk(&inst->config, inst->driver_inst->data, cache_snapshot_add, snap) < 0) {
+		talloc_free(snap);
+		ret = -1;
+	} else {
+		ret = cache_snapshot_close(snap);
+	}
+	pthread_mutex_unlock(&mutable->snapshot_mutex);
 
 	return ret;
 }
 
+typedef struct {
+	rlm_cache_t const	*inst;
+	REQUEST			*request;	//!< For the drivers, which expect one.
+	uint32_t		loaded;		//!< Entries inserted into the cache.
+} rlm_cache_snapshot_load_t;
+
+/** Insert an entry from a snapshot into the cache
+ *
+ * Entries which have expired since the snapshot was written, or which
+ * the cache has no room for, are skipped.
+ */
+static int _cache_snapshot_entry(uint8_t const *key, size_t key_len, char *data, size_t data_len, void *uctx)
+{
+	rlm_cache_snapshot_load_t	*load = uctx;
+	rlm_cache_t const		*inst = load->inst;
+	REQUEST				*request = load->request;
+	rlm_cache_entry_t		*c;
+	rlm_cache_handle_t		*handle = NULL;
+	cache_status_t			ret;
+
+	c = cache_alloc(inst, request);
+	if (!c) return -1;
+
+	if (cache_deserialize(c, data, data_len) < 0) {
+		RWDEBUG("Skipping snapshot entry: %s", fr_strerror());
+	skip:
+		talloc_free(c);
+		return 0;
+	}
+	c->key = talloc_memdup(c, key, key_len);
+	c->key_len = key_len;
+
+	if (c->expires < request->packet->timestamp.tv_sec) goto skip;
+
+	if (cache_acquire(&handle, inst, NULL, request) < 0) {
+		talloc_free(c);
+		return -1;
+	}
+
+	if ((inst->config.max_entries > 0) && inst->driver->count &&
+	    (inst->driver->count(&inst->config, inst->driver_inst->data, request, handle) > inst->config.max_entries)) {
+		cache_release(inst, request, &handle);
+		goto skip;
+	}
+
+	if (c->negative && !cache_negative_reserve(inst, request, c->expires)) {
+		cache_release(inst, request, &handle);
+		goto skip;
+	}
+
+	ret = inst->driver->insert(&inst->config, inst->driver_inst->data, request, handle, c);
+	cache_release(inst, request, &handle);
+	if (ret != CACHE_OK) goto skip;
+
+	cache_free(inst, &c);
+	load->loaded++;
+
+	return 0;
+}
+
+/** Load the entries in the snapshot file into the cache
+ *
+ * @param[in] inst Module instance.
+ * @param[out] loaded Number of entries inserted into the cache.
+ * @return
+ *	- 0 on success, or if there's no snapshot.
+ *	- -1 on error.  Entries before the error are still loaded.
+ */
+static int cache_snapshot_read(rlm_cache_t const *inst, uint32_t *loaded)
+{
+	rlm_cache_snapshot_load_t	load = { .inst = inst };
+	uint32_t			count;
+	int				ret;
+
+	*loaded = 0;
+
+	load.request = request_alloc(NULL);
+	if (!load.request) return -1;
+
+	load.request->packet = fr_radius_alloc(load.request, false);
+	if (!load.request->packet) {
+		talloc_free(load.request);
+		return -1;
+	}
+	gettimeofday(&load.request->packet->timestamp, NULL);
+
+	ret = cache_snapshot_load(&count, inst->config.snapshot, _cache_snapshot_entry, &load);
+	talloc_free(load.request);
+
+	*loaded = load.loaded;
+
+	return ret;
+}
+
+/** Write a snapshot of the cache
+ *
+ * Returns the number of entries written.
+ *
+@verbatim
+"%{cache_snapshot:}" == 12
+@endverbatim
+ */
+static ssize_t cache_snapshot_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
+				   void const *mod_inst, UNUSED void const *xlat_inst,
+				   REQUEST *request, UNUSED char const *fmt)
+{
+	rlm_cache_t const	*inst = mod_inst;
+	int			ret;
+
+	if (!inst->config.snapshot) {
+		REDEBUG("No 'snapshot' file configured");
+		return -1;
+	}
+
+	ret = cache_snapshot_write(inst);
+	if (ret < 0) {
+		REDEBUG("Failed writing snapshot: %s", fr_strerror());
+		return -1;
+	}
+
+	RDEBUG2("Wrote %i entries to %s", ret, inst->config.snapshot);
+
+	*out = talloc_typed_asprintf(ctx, "%i", ret);
+	return talloc_array_length(*out) - 1;
+}
+
 /** Free any memory allocated under the instance
  *
  */
@@ -862,8 +1642,29 @@ static int mod_detach(void *instance)
 {
 	rlm_cache_t *inst = instance;
 
+	/*
+	 *	Write the snapshot while the driver still
+	 *	has its entries.
+	 */
+	if (inst->config.snapshot) {
+		if (inst->snapshot_loaded && (cache_snapshot_write(inst) < 0)) {
+			WARN("rlm_cache (%s) - Failed writing snapshot: %s", inst->config.name, fr_strerror());
+		}
+		pthread_mutex_destroy(&inst->snapshot_mutex);
+	}
+
 	talloc_free(inst->maps);
 
+	if (inst->claims) {
+		talloc_free(inst->claims);
+		pthread_mutex_destroy(&inst->claims_mutex);
+	}
+
+	if (inst->negative) {
+		talloc_free(inst->negative);
+		pthread_mutex_destroy(&inst->negative_mutex);
+	}
+
 	/*
 	 *	We need to explicitly free all children, so if the driver
 	 *	parented any memory off the instance, their destructors
@@ -877,12 +1678,70 @@ static int mod_detach(void *instance)
 	return 0;
 }
 
+/** Create this worker's L1
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_cache_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_cache_t const	*inst = instance;
+	rlm_cache_thread_t	*t = thread;
+
+	t->inst = inst;
+
+	if (inst->driver->thread_inst_size > 0) {
+		MEM(t->driver = talloc_zero_array(NULL, uint8_t, inst->driver->thread_inst_size));
+
+		if (inst->driver->thread_instantiate &&
+		    (inst->driver->thread_instantiate(&inst->config, inst->driver_inst->data, el, t->driver) < 0)) {
+			TALLOC_FREE(t->driver);
+			return -1;
+		}
+	}
+
+	if (!inst->l1) return 0;
+
+	t->l1 = cache_l1_alloc(NULL, inst);
+	if (!t->l1) return -1;
+
+	return 0;
+}
+
+/** Free this worker's L1, and the driver's thread instance data
+ *
+ * @param[in] thread	specific data.
+ * @return 0.
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_cache_thread_t	*t = thread;
+	rlm_cache_t const	*inst = t->inst;
+
+	TALLOC_FREE(t->l1);
+
+	if (t->driver) {
+		if (inst->driver->thread_detach) inst->driver->thread_detach(&inst->config,
+									     inst->driver_inst->data, t->driver);
+		TALLOC_FREE(t->driver);
+	}
+
+	return 0;
+}
+
 /** Register module xlats
  *
  */
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
-	rlm_cache_t *inst = instance;
+	rlm_cache_t	*inst = instance;
+	char		buffer[256];
 
 	inst->cs = conf;
 
@@ -894,6 +1753,24 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	 */
 	xlat_register(inst, inst->config.name, cache_xlat, NULL, NULL, 0, 0);
 
+	/*
+	 *	And the one for the driver's counters
+	 */
+	snprintf(buffer, sizeof(buffer), "%s_stats", inst->config.name);
+	xlat_register(inst, buffer, cache_stats_xlat, NULL, NULL, 0, 0);
+
+	/*
+	 *	And one for writing snapshots on demand
+	 */
+	snprintf(buffer, sizeof(buffer), "%s_snapshot", inst->config.name);
+	xlat_register(inst, buffer, cache_snapshot_xlat, NULL, NULL, 0, 0);
+
+	if (inst->config.snapshot && (pthread_mutex_init(&inst->snapshot_mutex, NULL) < 0)) {
+		cf_log_err(conf, "Failed initializing mutex: %s", fr_syserror(errno));
+		inst->config.snapshot = NULL;
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -949,6 +1826,8 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	rad_assert(inst->driver->insert);
 	rad_assert(inst->driver->expire);
 
+	inst->config.memory = module_memory(conf);
+
 	if (inst->driver->instantiate &&
 	    (inst->driver->instantiate(&inst->config, inst->driver_inst->data, driver_cs) < 0)) return -1;
 
@@ -966,6 +1845,89 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	/*
+	 *	The L1 keeps the entries the driver hands us.  Drivers
+	 *	which keep their entries in memory don't hand them over,
+	 *	and are as fast as an L1 anyway.
+	 */
+	if (inst->config.l1_max_entries) {
+		if (!inst->driver->free) {
+			cf_log_warn(conf, "Driver %s keeps its entries in memory.  Ignoring 'l1'", inst->driver->name);
+			inst->config.l1_max_entries = 0;
+		} else {
+			FR_INTEGER_BOUND_CHECK("l1.ttl", inst->config.l1_ttl, >=, 1);
+			FR_INTEGER_BOUND_CHECK("l1.ttl", inst->config.l1_ttl, <=, inst->config.ttl);
+
+			inst->l1 = cache_l1_shared_alloc(inst);
+			if (!inst->l1) {
+				cf_log_err(conf, "Failed allocating L1 state");
+				return -1;
+			}
+		}
+	}
+
+	/*
+	 *	Only needed if requests wait for each other,
+	 *	or share stale entries.
+	 */
+	if (timerisset(&inst->config.coalesce_timeout) || inst->config.stale_ttl) {
+		inst->claims = rbtree_create(NULL, cache_claim_cmp, NULL, 0);
+		if (!inst->claims) {
+			cf_log_err(conf, "Failed creating claims tree");
+			return -1;
+		}
+
+		if (pthread_mutex_init(&inst->claims_mutex, NULL) < 0) {
+			cf_log_err(conf, "Failed initializing mutex: %s", fr_syserror(errno));
+			talloc_free(inst->claims);
+			inst->claims = NULL;
+			return -1;
+		}
+	}
+
+	/*
+	 *	Only needed if the number of negative
+	 *	entries is limited.
+	 */
+	if (inst->config.negative_max_entries) {
+		inst->negative = talloc_array(NULL, time_t, inst->config.negative_max_entries);
+		if (!inst->negative) {
+			cf_log_err(conf, "Failed allocating negative entry ring");
+			return -1;
+		}
+
+		if (pthread_mutex_init(&inst->negative_mutex, NULL) < 0) {
+			cf_log_err(conf, "Failed initializing mutex: %s", fr_syserror(errno));
+			talloc_free(inst->negative);
+			inst->negative = NULL;
+			return -1;
+		}
+	}
+
+	/*
+	 *	Entries are loaded before any requests are
+	 *	processed, so nothing else is using the cache.
+	 */
+	if (inst->config.snapshot) {
+		uint32_t loaded;
+
+		if (!inst->driver->walk) {
+			cf_log_err(conf, "Driver %s doesn't support snapshots", inst->driver->name);
+			return -1;
+		}
+
+		if (cache_snapshot_read(inst, &loaded) < 0) {
+			cf_log_warn(conf, "Failed loading snapshot: %s", fr_strerror());
+		}
+		if (loaded) cf_log_info(conf, "Loaded %u entries from %s", loaded, inst->config.snapshot);
+
+		/*
+		 *	Don't replace a snapshot we haven't
+		 *	tried to load.
+		 */
+		inst->snapshot_loaded = true;
+	}
+
 	update = cf_section_find(inst->cs, "update", CF_IDENT_ANY);
 	if (!update) {
 		cf_log_err(conf, "Must have an 'update' section in order to cache anything");
@@ -1006,6 +1968,9 @@ rad_module_t rlm_cache = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_cache_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_cache_it,
 		[MOD_PREACCT]		= mod_cache_it,
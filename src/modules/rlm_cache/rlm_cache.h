@@ -26,18 +26,23 @@ RCSIDH(cache_h, "$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/dl.h>
+#include <freeradius-devel/io/memory.h>
 
 typedef struct cache_driver cache_driver_t;
 
 typedef void rlm_cache_handle_t;
 
+typedef struct cache_l1 cache_l1_t;
+typedef struct cache_l1_shared cache_l1_shared_t;
+
 #define MAX_ATTRMAP	128
 
 typedef enum {
 	CACHE_RECONNECT	= -2,				//!< Handle needs to be reconnected
 	CACHE_ERROR	= -1,				//!< Fatal error
 	CACHE_OK	= 0,				//!< Cache entry found/updated
-	CACHE_MISS	= 1				//!< Cache entry notfound
+	CACHE_MISS	= 1,				//!< Cache entry notfound
+	CACHE_YIELD	= 2				//!< Request yielded, waiting for the datastore
 } cache_status_t;
 
 /** Configuration for the rlm_cache module
@@ -50,9 +55,24 @@ typedef struct rlm_cache_config_t {
 	char const		*driver_name;		//!< Driver name.
 	vp_tmpl_t		*key;			//!< What to expand to get the value of the key.
 	uint32_t		ttl;			//!< How long an entry is valid for.
+	uint32_t		stale_ttl;		//!< How long an expired entry may still be used
+							//!< while another request refreshes it.
+	struct timeval		coalesce_timeout;	//!< How long to wait for another request to
+							//!< populate an entry.  Zero disables waiting.
 	uint32_t		max_entries;		//!< Maximum entries allowed.
+	uint32_t		negative_ttl;		//!< How long a negative entry is valid for.
+	uint32_t		negative_max_entries;	//!< Maximum negative entries allowed.
 	int32_t			epoch;			//!< Time after which entries are considered valid.
+	char const		*snapshot;		//!< File to save entries to on exit, and load
+							//!< them from on startup.
 	bool			stats;			//!< Generate statistics.
+
+	uint32_t		l1_max_entries;		//!< Entries in each worker's L1.  0 for no L1.
+	uint32_t		l1_ttl;			//!< How long an entry may be used from the L1.
+
+	fr_memory_t		*memory;		//!< Memory used by the module, and its limits.
+							//!< Drivers which keep entries in memory count
+							//!< them here.
 } rlm_cache_config_t;
 
 /*
@@ -71,14 +91,38 @@ typedef struct rlm_cache_t {
 	vp_map_t		*maps;			//!< Attribute map applied to users.
 							//!< and profiles.
 	CONF_SECTION		*cs;
+
+	rbtree_t		*claims;		//!< Keys which a request is populating.
+	pthread_mutex_t		claims_mutex;		//!< Protects the claims tree.
+
+	time_t			*negative;		//!< Expiry times of the negative entries we
+							//!< inserted, oldest first.
+	uint32_t		negative_head;		//!< Index of the oldest negative entry.
+	uint32_t		negative_count;		//!< Negative entries which haven't expired.
+	pthread_mutex_t		negative_mutex;		//!< Protects the negative entry ring.
+
+	pthread_mutex_t		snapshot_mutex;		//!< Only one snapshot may be written at a time.
+	bool			snapshot_loaded;	//!< Whether the snapshot may be replaced.
+
+	cache_l1_shared_t	*l1;			//!< Generations and counters for the L1s, or NULL
+							//!< if there are none.
 } rlm_cache_t;
 
+typedef struct rlm_cache_thread_t {
+	rlm_cache_t const	*inst;			//!< Instance of rlm_cache.
+	cache_l1_t		*l1;			//!< Entries this worker found recently, or NULL.
+	void			*driver;		//!< Driver's thread instance data, or NULL.
+} rlm_cache_thread_t;
+
 typedef struct rlm_cache_entry_t {
 	uint8_t const		*key;			//!< Key used to identify entry.
 	size_t			key_len;		//!< Length of key data.
 	long long int		hits;			//!< How many times the entry has been retrieved.
 	time_t			created;		//!< When the entry was created.
 	time_t			expires;		//!< When the entry expires.
+	bool			negative;		//!< Records that the key has nothing to cache.
+							//!< Negative entries have no maps.
+	bool			in_l1;			//!< Owned by a worker's L1, not the driver.
 
 	vp_map_t		*maps;			//!< Head of the maps list.
 } rlm_cache_entry_t;
@@ -98,6 +142,35 @@ typedef struct rlm_cache_entry_t {
  */
 typedef int		(*cache_instantiate_t)(rlm_cache_config_t const *config, void *instance, CONF_SECTION *conf);
 
+/** Instantiate a driver for a worker thread
+ *
+ * Drivers which talk to their datastore asynchronously use this to set up
+ * their connections in the worker's event list.
+ *
+ * The thread instance data is passed to the other callbacks as their handle,
+ * when the driver has no #cache_acquire_t callback, and the call is made
+ * on behalf of a worker.  It is NULL otherwise, e.g. when expanding
+ * %{cache:...}, and the driver must not yield.
+ *
+ * @param[in] config	of the rlm_cache module.  Should not be modified.
+ * @param[in] instance	Driver specific instance data.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	A uint8_t array of thread_inst_size.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+typedef int		(*cache_thread_instantiate_t)(rlm_cache_config_t const *config, void *instance,
+						      fr_event_list_t *el, void *thread);
+
+/** Free a driver's thread instance data
+ *
+ * @param[in] config	of the rlm_cache module.  Should not be modified.
+ * @param[in] instance	Driver specific instance data.
+ * @param[in] thread	instance data to free.
+ */
+typedef void		(*cache_thread_detach_t)(rlm_cache_config_t const *config, void *instance, void *thread);
+
 /** Allocate a new cache entry
  *
  */
@@ -125,12 +198,22 @@ typedef void		(*cache_entry_free_t)(rlm_cache_entry_t *c);
  * If the #rlm_cache_handle_t is inviable, the driver should return #CACHE_RECONNECT, to have
  * it reinitialised/reconnected.
  *
+ * If the driver has to wait for its datastore, it may send the query, yield the request
+ * and return #CACHE_YIELD.  It marks the request resumable once the datastore has answered,
+ * and is then called again with the same arguments, when it should return the result.
+ * The same applies to #cache_entry_insert_t, #cache_entry_expire_t and
+ * #cache_entry_set_ttl_t.
+ *
+ * If #cache_entry_expire_t yielded, and find is then called for the same key, the
+ * entry has just been removed, and the driver should return #CACHE_MISS.
+ *
  * @param[out] out Where to write a pointer to the retrieved entry (if there was one).
  * @param[in] config for this instance of the rlm_cache module.
  * @param[in] instance Driver specific instance data.
  * @param[in] request The current request.
- * @param[in] handle the driver gave us when we called #cache_acquire_t, or NULL if no
- *	#cache_acquire_t callback was provided.
+ * @param[in] handle the driver gave us when we called #cache_acquire_t, or the thread
+ *	instance data (see #cache_thread_instantiate_t) if no #cache_acquire_t callback
+ *	was provided.
  * @param[in] key to use to lookup cache entry
  * @param[in] key_len the length of the key string.
  * @return
@@ -138,6 +221,7 @@ typedef void		(*cache_entry_free_t)(rlm_cache_entry_t *c);
  *	- #CACHE_ERROR - If the lookup couldn't be completed.
  *	- #CACHE_OK - Lookup was successful.
  *	- #CACHE_MISS - No cached entry was found.
+ *	- #CACHE_YIELD - The request was yielded until the datastore answers.
  */
 typedef cache_status_t	(*cache_entry_find_t)(rlm_cache_entry_t **out, rlm_cache_config_t const *config,
 					      void *instance, REQUEST *request, void *handle,
@@ -162,13 +246,15 @@ typedef cache_status_t	(*cache_entry_find_t)(rlm_cache_entry_t **out, rlm_cache_
  * @param config for this instance of the rlm_cache module.
  * @param instance Driver specific instance data.
  * @param request The current request.
- * @param handle the driver gave us when we called #cache_acquire_t, or NULL if no
- *	#cache_acquire_t callback was provided.
+ * @param handle the driver gave us when we called #cache_acquire_t, or the thread
+ *	instance data (see #cache_thread_instantiate_t) if no #cache_acquire_t callback
+ *	was provided.
  * @param c to insert.
  * @return
  *	- #CACHE_RECONNECT - If handle needs to be reinitialised/reconnected.
  *	- #CACHE_ERROR - If the insert couldn't be completed.
  *	- #CACHE_OK - If the insert was successful.
+ *	- #CACHE_YIELD - The request was yielded until the datastore answers.
  */
 typedef cache_status_t	(*cache_entry_insert_t)(rlm_cache_config_t const *config, void *instance,
 						REQUEST *request, void *handle,
@@ -181,8 +267,9 @@ typedef cache_status_t	(*cache_entry_insert_t)(rlm_cache_config_t const *config,
  * @param[in] config for this instance of the rlm_cache module.
  * @param[in] instance Driver specific instance data.
  * @param[in] request The current request.
- * @param[in] handle the driver gave us when we called #cache_acquire_t, or NULL if no
- *	#cache_acquire_t callback was provided.
+ * @param[in] handle the driver gave us when we called #cache_acquire_t, or the thread
+ *	instance data (see #cache_thread_instantiate_t) if no #cache_acquire_t callback
+ *	was provided.
  * @param[in] key of entry to expire.
  * @param[in] key_len the length of the key string.
  * @return
@@ -190,6 +277,7 @@ typedef cache_status_t	(*cache_entry_insert_t)(rlm_cache_config_t const *config,
  *	- #CACHE_ERROR - If the entry couldn't be expired.
  *	- #CACHE_OK - If the entry was expired.
  *	- #CACHE_MISS - If the entry didn't exist, so couldn't be expired.
+ *	- #CACHE_YIELD - The request was yielded until the datastore answers.
  */
 typedef cache_status_t	(*cache_entry_expire_t)(rlm_cache_config_t const *config, void *instance,
 						REQUEST *request, void *handle,
@@ -206,13 +294,15 @@ typedef cache_status_t	(*cache_entry_expire_t)(rlm_cache_config_t const *config,
  * @param[in] config for this instance of the rlm_cache module.
  * @param[in] instance Driver specific instance data.
  * @param[in] request The current request.
- * @param[in] handle the driver gave us when we called #cache_acquire_t, or NULL if no
- *	#cache_acquire_t callback was provided.
+ * @param[in] handle the driver gave us when we called #cache_acquire_t, or the thread
+ *	instance data (see #cache_thread_instantiate_t) if no #cache_acquire_t callback
+ *	was provided.
  * @param[in] c to update the TTL of. c->ttl will have been set to the new value.
  * @return
  *	- #CACHE_RECONNECT - If handle needs to be reinitialised/reconnected.
  *	- #CACHE_ERROR - If the entry TTL couldn't be updated.
  *	- #CACHE_OK - If the entry's TTL was updated.
+ *	- #CACHE_YIELD - The request was yielded until the datastore answers.
  */
 typedef cache_status_t	(*cache_entry_set_ttl_t)(rlm_cache_config_t const *config, void *instance,
 						 REQUEST *request, void *handle,
@@ -225,13 +315,63 @@ typedef cache_status_t	(*cache_entry_set_ttl_t)(rlm_cache_config_t const *config
  * @param[in] config for this instance of the rlm_cache module.
  * @param[in] instance Driver specific instance data.
  * @param[in] request The current request.
- * @param handle the driver gave us when we called #cache_acquire_t, or NULL if no
- *	#cache_acquire_t callback was provided.
+ * @param handle the driver gave us when we called #cache_acquire_t, or the thread
+ *	instance data (see #cache_thread_instantiate_t) if no #cache_acquire_t callback
+ *	was provided.
  * @return number of entries in the cache.
  */
 typedef uint32_t	(*cache_entry_count_t)(rlm_cache_config_t const *config, void *instance,
 					       REQUEST *request, void *handle);
 
+/** Called for each entry by #cache_entry_walk_t
+ *
+ * @param[in] c the entry.  Must not be modified, or kept after returning.
+ * @param[in] uctx passed to #cache_entry_walk_t.
+ * @return
+ *	- 0 to continue.
+ *	- -1 to stop walking.
+ */
+typedef int		(*cache_entry_walk_cb_t)(rlm_cache_entry_t const *c, void *uctx);
+
+/** Call a function for every entry in the cache
+ *
+ * Used to write snapshots of drivers which keep their entries in memory.
+ *
+ * @note This callback is optional.  Snapshots can't be used if it is not provided.
+ *
+ * @param[in] config for this instance of the rlm_cache module.
+ * @param[in] instance Driver specific instance data.
+ * @param[in] func to call for each entry.
+ * @param[in] uctx to pass to func.
+ * @return
+ *	- 0 if every entry was visited.
+ *	- -1 if func stopped the walk.
+ */
+typedef int		(*cache_entry_walk_t)(rlm_cache_config_t const *config, void *instance,
+					      cache_entry_walk_cb_t func, void *uctx);
+
+/** Counters kept by a driver for the entries it stores
+ *
+ */
+typedef struct {
+	uint64_t		hits;			//!< Lookups which found a live entry.
+	uint64_t		misses;			//!< Lookups which didn't.
+	uint64_t		evictions;		//!< Entries removed to make room for others.
+	uint64_t		rejected;		//!< New entries which weren't kept.
+	uint64_t		entries;		//!< Entries currently stored.
+	uint64_t		memory;			//!< Bytes used by the entries currently stored.
+} rlm_cache_stats_t;
+
+/** Get the counters for the cache
+ *
+ * @note This callback is optional.
+ *
+ * @param[out] out Where to write the counters.
+ * @param[in] config for this instance of the rlm_cache module.
+ * @param[in] instance Driver specific instance data.
+ */
+typedef void		(*cache_stats_t)(rlm_cache_stats_t *out, rlm_cache_config_t const *config, void *instance);
+
 /** Acquire a handle to access the cache
  *
  * @note This callback is optional. If it's not provided the handle argument to other callbacks
@@ -276,10 +416,27 @@ typedef void		(*cache_release_t)(rlm_cache_config_t const *config, void *instanc
 typedef int		(*cache_reconnect_t)(rlm_cache_handle_t **handle, rlm_cache_config_t const *config,
 					     void *instance, REQUEST *request);
 
+/** Stop waiting for the datastore
+ *
+ * Called if a request which the driver yielded is done before it resumes.
+ * The driver must not mark the request resumable after this.
+ *
+ * @note This callback is not optional for drivers which return #CACHE_YIELD.
+ *
+ * @param[in] config for this instance of the rlm_cache module.
+ * @param[in] instance Driver specific instance data.
+ * @param[in] request The yielded request.
+ */
+typedef void		(*cache_cancel_t)(rlm_cache_config_t const *config, void *instance, REQUEST *request);
+
 struct cache_driver {
 	RAD_MODULE_COMMON;					//!< Common fields for all loadable modules.
 
 	cache_instantiate_t		instantiate;		//!< (optional) Instantiate a driver.
+	size_t				thread_inst_size;	//!< (optional) Size of the driver's thread
+								//!< instance data.
+	cache_thread_instantiate_t	thread_instantiate;	//!< (optional) Instantiate a driver for a worker.
+	cache_thread_detach_t		thread_detach;		//!< (optional) Free a worker's driver data.
 	cache_entry_alloc_t		alloc;			//!< (optional) Allocate a new entry.
 	cache_entry_free_t		free;			//!< (optional) Free memory used by an entry.
 
@@ -289,10 +446,13 @@ struct cache_driver {
 	cache_entry_set_ttl_t		set_ttl;		//!< (Optional) Update the TTL of an entry.
 	cache_entry_count_t		count;			//!< (Optional) Number of entries currently in
 								//!< the cache.
+	cache_stats_t			stats;			//!< (Optional) Hit, miss and eviction counters.
+	cache_entry_walk_t		walk;			//!< (Optional) Visit every entry, for snapshots.
 
 	cache_acquire_t			acquire;		//!< (optional) Acquire exclusive access to a resource
 								//!< used to retrieve the cache entry.
 	cache_release_t			release;		//!< (optional) Release access to resource acquired
 								//!< with acquire callback.
 	cache_reconnect_t		reconnect;		//!< (optional) Re-initialise resource.
+	cache_cancel_t			cancel;			//!< (optional) Stop waiting for the datastore.
 };
@@ -28,6 +28,47 @@ RCSID("$Id$")
 #include "rlm_cache.h"
 #include "serialize.h"
 
+/*
+ *	Binary entries look like this.  All integers are in network
+ *	byte order.
+ *
+ *	  0                   1                   2                   3
+ *	  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |     Magic     |    Version    |     Flags     |   Reserved    |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |                      Created (64 bits)                        |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |                      Expires (64 bits)                        |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |  Maps...
+ *	 +-+-+-+-+-+-+-+-+-
+ *
+ *	Each map is:
+ *
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |   Operator    |    Request    |     List      |      Tag      |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |     Depth     |  Attribute numbers, from the dictionary root,
+ *	 +-+-+-+-+-+-+-+-+  Depth x 32 bits ...
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |                         Value length                          |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |  Value, as written by fr_value_box_to_network() ...
+ *	 +-+-+-+-+-+-+-+-+-
+ *
+ *	The text format always starts with '&', so the magic number
+ *	tells the two apart.  Entries with flags we don't know about
+ *	are rejected, so new ones can be used for things like
+ *	compression later.
+ */
+#define CACHE_BINARY_MAGIC	(0xfc)
+#define CACHE_BINARY_VERSION	(1)
+#define CACHE_BINARY_HDR_LEN	(20)
+#define CACHE_BINARY_MAX_DEPTH	(16)
+
+#define CACHE_BINARY_FLAG_NEGATIVE	(0x01)	//!< Entry is negative, and has no maps.
+
 /** Serialize a cache entry as a humanly readable string
  *
  * @param ctx to alloc new string in. Should be a talloc pool a little bigger
@@ -50,6 +91,11 @@ int cache_serialize(TALLOC_CTX *ctx, char **out, rlm_cache_entry_t const *c)
 				   (uint64_t)c->expires, (uint64_t)c->created);
 	if (!to_store) return -1;
 
+	if (c->negative) {
+		to_store = talloc_strdup_append_buffer(to_store, "&Cache-Negative = yes\n");
+		if (!to_store) return -1;
+	}
+
 	/*
 	 *	It's valid to have an empty cache entry (save allocing the pairs pool)
 	 */
@@ -89,10 +135,238 @@ finish:
 	return 0;
 }
 
+/** Serialize a cache entry in the compact binary format
+ *
+ * Attributes are identified by number, and values written in network
+ * byte order, so entries are smaller and much cheaper to decode than
+ * the text format.
+ *
+ * Unknown attributes, and values which have no network representation,
+ * can't be written.  Callers should fall back to #cache_serialize for
+ * those entries.
+ *
+ * @param ctx to alloc the buffer in.
+ * @param out Where to write pointer to serialized cache entry.
+ * @param outlen Where to write the length of the serialized entry.
+ * @param c Cache entry to serialize.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, size_t *outlen, rlm_cache_entry_t const *c)
+{
+	vp_map_t	*map;
+	uint8_t		*buff, *p;
+	size_t		len = CACHE_BINARY_HDR_LEN;
+	uint64_t	u64;
+
+	/*
+	 *	Figure out how much room we need, and check
+	 *	every map can be written.
+	 */
+	for (map = c->maps; map; map = map->next) {
+		fr_dict_attr_t const *da = map->lhs->tmpl_da;
+
+		if ((map->lhs->type != TMPL_TYPE_ATTR) || da->flags.is_unknown || da->flags.is_raw ||
+		    (da->depth == 0) || (da->depth > CACHE_BINARY_MAX_DEPTH)) {
+			fr_strerror_printf("Can't serialize attribute \"%s\" in binary", map->lhs->name);
+			return -1;
+		}
+
+		if ((map->rhs->type != TMPL_TYPE_DATA) || (map->rhs->tmpl_value_type != da->type)) {
+			fr_strerror_printf("Can't serialize value of \"%s\" in binary", map->lhs->name);
+			return -1;
+		}
+
+		switch (da->type) {
+		case FR_TYPE_SIZE:
+		case FR_TYPE_TIMEVAL:
+		case FR_TYPE_ABINARY:
+		case FR_TYPE_NON_VALUES:
+			fr_strerror_printf("Can't serialize %s value of \"%s\" in binary",
+					   fr_int2str(dict_attr_types, da->type, "<INVALID>"), map->lhs->name);
+			return -1;
+
+		default:
+			break;
+		}
+
+		len += 5 + (da->depth * 4) + 4 + fr_value_box_network_length(&map->rhs->tmpl_value);
+	}
+
+	buff = p = talloc_array(ctx, uint8_t, len);
+	if (!buff) return -1;
+
+	*p++ = CACHE_BINARY_MAGIC;
+	*p++ = CACHE_BINARY_VERSION;
+	*p++ = c->negative ? CACHE_BINARY_FLAG_NEGATIVE : 0;
+	*p++ = 0;
+
+	u64 = htonll((uint64_t)c->created);
+	memcpy(p, &u64, sizeof(u64));
+	p += sizeof(u64);
+
+	u64 = htonll((uint64_t)c->expires);
+	memcpy(p, &u64, sizeof(u64));
+	p += sizeof(u64);
+
+	for (map = c->maps; map; map = map->next) {
+		fr_dict_attr_t const	*da;
+		uint32_t		u32;
+		uint8_t			*value_len;
+		ssize_t			slen;
+		unsigned int		i;
+
+		*p++ = map->op;
+		*p++ = map->lhs->tmpl_request;
+		*p++ = map->lhs->tmpl_list;
+		*p++ = (uint8_t)map->lhs->tmpl_tag;
+		*p++ = map->lhs->tmpl_da->depth;
+
+		/*
+		 *	Write the attribute numbers leaf first,
+		 *	so they come out root first.
+		 */
+		p += map->lhs->tmpl_da->depth * 4;
+		for (da = map->lhs->tmpl_da, i = 1; !da->flags.is_root; da = da->parent, i++) {
+			u32 = htonl(da->attr);
+			memcpy(p - (i * 4), &u32, sizeof(u32));
+		}
+
+		value_len = p;
+		p += 4;
+
+		slen = fr_value_box_to_network(NULL, p, len - (p - buff), &map->rhs->tmpl_value);
+		if (slen < 0) {
+			talloc_free(buff);
+			return -1;
+		}
+		p += slen;
+
+		u32 = htonl((uint32_t)slen);
+		memcpy(value_len, &u32, sizeof(u32));
+	}
+
+	*out = buff;
+	*outlen = p - buff;
+
+	return 0;
+}
+
+/** Converts a binary serialized cache entry back into a structure
+ *
+ */
+static int cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen)
+{
+	vp_map_t	**last = &c->maps;
+	uint8_t const	*p = in, *end = in + inlen;
+	uint64_t	u64;
+
+	if (inlen < CACHE_BINARY_HDR_LEN) {
+		fr_strerror_printf("Binary entry too short, expected at least %u bytes, got %zu bytes",
+				   CACHE_BINARY_HDR_LEN, inlen);
+		return -1;
+	}
+
+	if (p[1] != CACHE_BINARY_VERSION) {
+		fr_strerror_printf("Unsupported binary entry version %u", p[1]);
+		return -1;
+	}
+
+	if (p[2] & ~CACHE_BINARY_FLAG_NEGATIVE) {
+		fr_strerror_printf("Unsupported binary entry flags 0x%02x", p[2]);
+		return -1;
+	}
+	c->negative = (p[2] & CACHE_BINARY_FLAG_NEGATIVE);
+	p += 4;
+
+	memcpy(&u64, p, sizeof(u64));
+	c->created = (time_t)ntohll(u64);
+	p += sizeof(u64);
+
+	memcpy(&u64, p, sizeof(u64));
+	c->expires = (time_t)ntohll(u64);
+	p += sizeof(u64);
+
+	while (p < end) {
+		fr_dict_attr_t const	*da;
+		vp_map_t		*map;
+		fr_value_box_t		value;
+		uint32_t		u32;
+		unsigned int		depth, i;
+		char			attr[256];
+		size_t			len;
+
+		if ((end - p) < 5) {
+		truncated:
+			fr_strerror_printf("Binary entry truncated at offset %zu", (size_t)(p - in));
+			return -1;
+		}
+
+		MEM(map = talloc_zero(c, vp_map_t));
+		map->op = p[0];
+		if ((map->op <= T_INVALID) || (map->op >= T_TOKEN_LAST)) {
+			fr_strerror_printf("Invalid operator %u at offset %zu", p[0], (size_t)(p - in));
+		error:
+			talloc_free(map);
+			return -1;
+		}
+
+		depth = p[4];
+		if ((depth == 0) || (depth > CACHE_BINARY_MAX_DEPTH) || ((size_t)(end - p) < (5 + (depth * 4) + 4))) {
+			talloc_free(map);
+			goto truncated;
+		}
+
+		for (da = fr_dict_root(fr_dict_internal), i = 0; i < depth; i++) {
+			memcpy(&u32, p + 5 + (i * 4), sizeof(u32));
+			da = fr_dict_attr_child_by_num(da, ntohl(u32));
+			if (!da) {
+				fr_strerror_printf("Unknown attribute at offset %zu.  Check local dictionaries",
+						   (size_t)(p - in));
+				goto error;
+			}
+		}
+
+		MEM(map->lhs = talloc(map, vp_tmpl_t));
+		tmpl_from_da(map->lhs, da, (int8_t)p[3], NUM_ANY, p[1], p[2]);
+
+		len = tmpl_snprint(attr, sizeof(attr), map->lhs);
+		if (is_truncated(len, sizeof(attr))) {
+			fr_strerror_printf("Attribute name too long");
+			goto error;
+		}
+		map->lhs->name = talloc_strdup(map->lhs, attr);
+		map->lhs->len = len;
+
+		p += 5 + (depth * 4);
+
+		memcpy(&u32, p, sizeof(u32));
+		u32 = ntohl(u32);
+		p += 4;
+		if ((size_t)(end - p) < u32) {
+			talloc_free(map);
+			goto truncated;
+		}
+
+		if (fr_value_box_from_network(map, &value, da->type, da, p, u32, true) < 0) goto error;
+		p += u32;
+
+		if (tmpl_afrom_value_box(map, &map->rhs, &value, true) < 0) goto error;
+
+		*last = map;
+		last = &(*last)->next;
+	}
+
+	return 0;
+}
+
 /** Converts a serialized cache entry back into a structure
+ *
+ * Accepts both the text and the binary formats.
  *
  * @param c Cache entry to populate (should already be allocated)
- * @param in String representation of cache entry.
+ * @param in Serialized cache entry.
  * @param inlen Length of string. May be < 0 in which case strlen will be
  *	used to calculate the length of the string.
  * @return
@@ -106,6 +380,14 @@ int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen)
 
 	if (inlen < 0) inlen = strlen(in);
 
+	/*
+	 *	Entries written by servers which support the binary
+	 *	format may be mixed with text ones.
+	 */
+	if ((inlen > 0) && ((uint8_t)in[0] == CACHE_BINARY_MAGIC)) {
+		return cache_deserialize_binary(c, (uint8_t const *)in, inlen);
+	}
+
 	p = in;
 
 	while (((size_t)(p - in)) < (size_t)inlen) {
@@ -158,6 +440,11 @@ int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen)
 			talloc_free(map);
 			goto next;
 
+		case FR_CACHE_NEGATIVE:
+			c->negative = (map->rhs->tmpl_value.vb_uint32 > 0);
+			talloc_free(map);
+			goto next;
+
 		default:
 			break;
 		}
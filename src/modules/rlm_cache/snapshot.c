@@ -0,0 +1,342 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file snapshot.c
+ * @brief Write and read snapshots of cache entries.
+ *
+ * Snapshots let in-memory caches survive a restart.  The file is a
+ * header followed by one record per entry.  All integers are in network
+ * byte order.
+ *
+ *	  0                   1                   2                   3
+ *	  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |                        Magic ("FRcs")                         |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |    Version    |                   Reserved                    |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |                     Written (64 bits)                         |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |  Records...
+ *	 +-+-+-+-+-+-+-+-+-
+ *
+ * Each record is:
+ *
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |                          Key length                           |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |                          Data length                          |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |                    Checksum of key and data                   |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |                           Reserved                            |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |  Key, then the entry as written by cache_serialize_binary()
+ *	 |  or cache_serialize(), padded to a multiple of 8 bytes ...
+ *	 +-+-+-+-+-+-+-+-+-
+ *
+ * Records are aligned, and self-describing, so the file can be mapped
+ * and each entry handed to the cache as soon as its checksum has been
+ * verified.  Loading stops at the first record which doesn't verify,
+ * which is also what a truncated file looks like.
+ *
+ * Snapshots are written to a temporary file, which is renamed over the
+ * old snapshot when complete, so a crash part way through writing never
+ * leaves a damaged snapshot behind.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rlm_cache.h"
+#include "serialize.h"
+#include "snapshot.h"
+
+#define CACHE_SNAPSHOT_MAGIC		"FRcs"
+#define CACHE_SNAPSHOT_VERSION		(1)
+#define CACHE_SNAPSHOT_HDR_LEN		(16)
+#define CACHE_SNAPSHOT_RECORD_HDR_LEN	(16)
+#define CACHE_SNAPSHOT_ALIGN(_x)	(((_x) + 7) & ~((size_t)7))
+
+struct cache_snapshot {
+	char const		*file;		//!< Snapshot we're replacing.
+	char			*tmp;		//!< Where we're writing.
+	FILE			*fp;		//!< Open handle for tmp.
+	time_t			now;		//!< Entries which expire before this aren't written.
+	uint32_t		count;		//!< Number of entries written.
+	bool			error;		//!< Whether a write failed.
+};
+
+/** Close the temporary file, and remove it if it wasn't renamed
+ *
+ */
+static int _cache_snapshot_free(cache_snapshot_t *snap)
+{
+	if (snap->fp) {
+		fclose(snap->fp);
+		unlink(snap->tmp);
+	}
+
+	return 0;
+}
+
+/** Start writing a new snapshot
+ *
+ * @param[in] ctx to allocate the snapshot in.  Freeing it abandons the snapshot.
+ * @param[in] file to replace when the snapshot is complete.
+ * @return
+ *	- A new snapshot.
+ *	- NULL on error.
+ */
+cache_snapshot_t *cache_snapshot_open(TALLOC_CTX *ctx, char const *file)
+{
+	cache_snapshot_t	*snap;
+	uint8_t			hdr[CACHE_SNAPSHOT_HDR_LEN];
+	uint64_t		u64;
+
+	MEM(snap = talloc_zero(ctx, cache_snapshot_t));
+	snap->file = file;
+	snap->tmp = talloc_typed_asprintf(snap, "%s.tmp", file);
+	snap->now = time(NULL);
+
+	snap->fp = fopen(snap->tmp, "w");
+	if (!snap->fp) {
+		fr_strerror_printf("Failed opening %s: %s", snap->tmp, fr_syserror(errno));
+		talloc_free(snap);
+		return NULL;
+	}
+	talloc_set_destructor(snap, _cache_snapshot_free);
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, CACHE_SNAPSHOT_MAGIC, 4);
+	hdr[4] = CACHE_SNAPSHOT_VERSION;
+	u64 = htonll((uint64_t)snap->now);
+	memcpy(hdr + 8, &u64, sizeof(u64));
+
+	if (fwrite(hdr, sizeof(hdr), 1, snap->fp) != 1) {
+		fr_strerror_printf("Failed writing %s: %s", snap->tmp, fr_syserror(errno));
+		talloc_free(snap);
+		return NULL;
+	}
+
+	return snap;
+}
+
+/** Add an entry to a snapshot
+ *
+ * Entries which have already expired are skipped.  Matches the
+ * signature of #cache_entry_walk_cb_t, so a driver can walk its
+ * entries straight into the snapshot.
+ *
+ * @param[in] c entry to write.
+ * @param[in] uctx the #cache_snapshot_t being written.
+ * @return
+ *	- 0 on success, or if the entry was skipped.
+ *	- -1 if the snapshot couldn't be written.
+ */
+int cache_snapshot_add(rlm_cache_entry_t const *c, void *uctx)
+{
+	cache_snapshot_t	*snap = talloc_get_type_abort(uctx, cache_snapshot_t);
+	TALLOC_CTX		*pool;
+	uint8_t			hdr[CACHE_SNAPSHOT_RECORD_HDR_LEN];
+	uint8_t			*data;
+	size_t			data_len, pad_len;
+	uint32_t		u32, hash;
+	static uint8_t const	pad[8];
+
+	if (c->expires < snap->now) return 0;
+
+	pool = talloc_pool(NULL, 1024);
+	if (!pool) return -1;
+
+	if (cache_serialize_binary(pool, &data, &data_len, c) < 0) {
+		char *text;
+
+		if (cache_serialize(pool, &text, c) < 0) {
+			talloc_free(pool);
+			return 0;	/* Can't write this one, carry on with the others */
+		}
+		data = (uint8_t *)text;
+		data_len = talloc_array_length(text) - 1;
+	}
+
+	/*
+	 *	Checksum of the key followed by the data
+	 */
+	hash = fr_hash_update(data, data_len, fr_hash(c->key, c->key_len));
+
+	memset(hdr, 0, sizeof(hdr));
+	u32 = htonl((uint32_t)c->key_len);
+	memcpy(hdr, &u32, sizeof(u32));
+	u32 = htonl((uint32_t)data_len);
+	memcpy(hdr + 4, &u32, sizeof(u32));
+	u32 = htonl(hash);
+	memcpy(hdr + 8, &u32, sizeof(u32));
+
+	pad_len = CACHE_SNAPSHOT_ALIGN(c->key_len + data_len) - (c->key_len + data_len);
+
+	if ((fwrite(hdr, sizeof(hdr), 1, snap->fp) != 1) ||
+	    (fwrite(c->key, c->key_len, 1, snap->fp) != 1) ||
+	    (data_len && (fwrite(data, data_len, 1, snap->fp) != 1)) ||
+	    (pad_len && (fwrite(pad, pad_len, 1, snap->fp) != 1))) {
+		fr_strerror_printf("Failed writing %s: %s", snap->tmp, fr_syserror(errno));
+		snap->error = true;
+		talloc_free(pool);
+		return -1;
+	}
+	talloc_free(pool);
+
+	snap->count++;
+
+	return 0;
+}
+
+/** Finish writing a snapshot, and replace the old one
+ *
+ * The snapshot is freed whether or not this succeeds.
+ *
+ * @param[in] snap to finish.
+ * @return
+ *	- The number of entries written.
+ *	- -1 on error.
+ */
+int cache_snapshot_close(cache_snapshot_t *snap)
+{
+	int ret = snap->count;
+
+	if (snap->error) {
+		talloc_free(snap);
+		return -1;
+	}
+
+	if ((fflush(snap->fp) != 0) || (fsync(fileno(snap->fp)) < 0)) {
+		fr_strerror_printf("Failed writing %s: %s", snap->tmp, fr_syserror(errno));
+		talloc_free(snap);
+		return -1;
+	}
+
+	if (rename(snap->tmp, snap->file) < 0) {
+		fr_strerror_printf("Failed renaming %s to %s: %s", snap->tmp, snap->file, fr_syserror(errno));
+		talloc_free(snap);
+		return -1;
+	}
+
+	fclose(snap->fp);
+	snap->fp = NULL;
+	talloc_free(snap);
+
+	return ret;
+}
+
+/** Read the entries from a snapshot
+ *
+ * The file is mapped privately, so entries can be deserialized in place.
+ * Each record is checked before it's passed to func, so entries before
+ * a damaged record are still loaded.
+ *
+ * @param[out] count of entries passed to func.
+ * @param[in] file to read.
+ * @param[in] func to call for each entry.
+ * @param[in] uctx to pass to func.
+ * @return
+ *	- 0 on success, or if the file doesn't exist.
+ *	- -1 if the file isn't a snapshot, couldn't be read, or is damaged.
+ */
+int cache_snapshot_load(uint32_t *count, char const *file, cache_snapshot_entry_t func, void *uctx)
+{
+	int		fd;
+	struct stat	st;
+	uint8_t		*map, *p, *end;
+
+	*count = 0;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) return 0;
+
+		fr_strerror_printf("Failed opening %s: %s", file, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		fr_strerror_printf("Failed reading %s: %s", file, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if ((size_t)st.st_size < CACHE_SNAPSHOT_HDR_LEN) {
+		fr_strerror_printf("%s is too short to be a snapshot", file);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fr_strerror_printf("Failed mapping %s: %s", file, fr_syserror(errno));
+		return -1;
+	}
+
+	if ((memcmp(map, CACHE_SNAPSHOT_MAGIC, 4) != 0) || (map[4] != CACHE_SNAPSHOT_VERSION)) {
+		fr_strerror_printf("%s is not a version %u snapshot", file, CACHE_SNAPSHOT_VERSION);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	p = map + CACHE_SNAPSHOT_HDR_LEN;
+	end = map + st.st_size;
+
+	while (p < end) {
+		uint32_t	key_len, data_len, hash, u32;
+		uint8_t		*key;
+
+		if ((size_t)(end - p) < CACHE_SNAPSHOT_RECORD_HDR_LEN) {
+		bad_record:
+			fr_strerror_printf("Bad record at offset %zu, ignoring the rest of %s",
+					   (size_t)(p - map), file);
+			munmap(map, st.st_size);
+			return -1;
+		}
+
+		memcpy(&u32, p, sizeof(u32));
+		key_len = ntohl(u32);
+		memcpy(&u32, p + 4, sizeof(u32));
+		data_len = ntohl(u32);
+		memcpy(&u32, p + 8, sizeof(u32));
+		hash = ntohl(u32);
+
+		if ((key_len == 0) ||
+		    ((size_t)(end - p) < (CACHE_SNAPSHOT_RECORD_HDR_LEN + (size_t)key_len + data_len))) goto bad_record;
+
+		key = p + CACHE_SNAPSHOT_RECORD_HDR_LEN;
+		if (fr_hash_update(key + key_len, data_len, fr_hash(key, key_len)) != hash) goto bad_record;
+
+		if (func(key, key_len, (char *)(key + key_len), data_len, uctx) < 0) break;
+		(*count)++;
+
+		p += CACHE_SNAPSHOT_RECORD_HDR_LEN + CACHE_SNAPSHOT_ALIGN((size_t)key_len + data_len);
+	}
+
+	munmap(map, st.st_size);
+
+	return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ * @file snapshot.h
+ * @brief Write and read snapshots of cache entries.
+ *
+ * @copyright 2026  The FreeRADIUS server project
+ */
+RCSIDH(snapshot_h, "$Id$")
+
+typedef struct cache_snapshot cache_snapshot_t;
+
+/** Called for each valid entry in a snapshot
+ *
+ * @param[in] key of the entry.
+ * @param[in] key_len the length of the key.
+ * @param[in] data serialized entry, may be modified.
+ * @param[in] data_len the length of the serialized entry.
+ * @param[in] uctx passed to #cache_snapshot_load.
+ * @return
+ *	- 0 to continue.
+ *	- -1 to stop loading.
+ */
+typedef int (*cache_snapshot_entry_t)(uint8_t const *key, size_t key_len, char *data, size_t data_len, void *uctx);
+
+cache_snapshot_t *cache_snapshot_open(TALLOC_CTX *ctx, char const *file);
+int cache_snapshot_add(rlm_cache_entry_t const *c, void *uctx);
+int cache_snapshot_close(cache_snapshot_t *snap);
+int cache_snapshot_load(uint32_t *count, char const *file, cache_snapshot_entry_t func, void *uctx);
@@ -187,6 +187,7 @@ extern rad_module_t rlm_chap;
 rad_module_t rlm_chap = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "chap",
+	.type		= RLM_TYPE_SHADOW_SAFE,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
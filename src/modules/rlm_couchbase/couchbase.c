@@ -129,6 +129,52 @@ void couchbase_get_callback(lcb_t instance, const void *cookie, lcb_error_t erro
 	}
 }
 
+/** Couchbase callback for asynchronous get (read) operations
+ *
+ * Parses the document as #couchbase_get_callback does, then completes the operation.
+ *
+ * @param instance Couchbase connection instance.
+ * @param cookie   The #couchbase_op_t passed to #couchbase_get_key_async.
+ * @param error    Couchbase error object.
+ * @param resp     Couchbase get operation response object.
+ */
+void couchbase_async_get_callback(lcb_t instance, const void *cookie, lcb_error_t error, const lcb_get_resp_t *resp)
+{
+	cookie_u cu;                            /* union of const and non const pointers */
+	cu.cdata = cookie;                      /* set const union member to cookie passed from couchbase */
+	couchbase_op_t *op = cu.data;           /* set our op struct using non-const member */
+
+	couchbase_get_callback(instance, cookie, error, resp);
+
+	/* free token */
+	json_tokener_free(op->cookie.jtok);
+	op->cookie.jtok = NULL;
+
+	op->error = error;
+	op->callback(op);
+}
+
+/** Couchbase callback for asynchronous store (write) operations
+ *
+ * @param instance  Couchbase connection instance.
+ * @param cookie    The #couchbase_op_t passed to #couchbase_set_key_async.
+ * @param operation Couchbase storage operation object.
+ * @param error     Couchbase error object.
+ * @param resp      Couchbase store operation response object.
+ */
+void couchbase_async_store_callback(lcb_t instance, const void *cookie, lcb_storage_t operation,
+				    lcb_error_t error, const lcb_store_resp_t *resp)
+{
+	cookie_u cu;                            /* union of const and non const pointers */
+	cu.cdata = cookie;                      /* set const union member to cookie passed from couchbase */
+	couchbase_op_t *op = cu.data;           /* set our op struct using non-const member */
+
+	couchbase_store_callback(instance, cookie, operation, error, resp);
+
+	op->error = error;
+	op->callback(op);
+}
+
 /** Couchbase callback for http (view) operations
  *
  * @param request  Couchbase http request object.
@@ -181,20 +227,18 @@ void couchbase_http_data_callback(lcb_http_request_t request, lcb_t instance, co
 	(void)request;
 }
 
-/** Initialize a Couchbase connection instance
- *
- * Initialize all information relating to a Couchbase instance and configure available method callbacks.
- * This function forces synchronous operation and will wait for a connection or timeout.
+/** Create a Couchbase connection instance and start connecting to the cluster
  *
  * @param instance Empty (un-allocated) Couchbase instance object.
  * @param host       The Couchbase server or list of servers.
  * @param bucket     The Couchbase bucket to associate with the instance.
  * @param pass       The Couchbase bucket password (NULL if none).
- * @param timeout    Maximum time to wait for obtaining the initial configuration.
+ * @param timeout    Maximum time to wait for obtaining the initial configuration (0 = default).
+ * @param io         IO table to use, NULL for the libcouchbase default.
  * @return           Couchbase error object.
  */
-lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const char *bucket, const char *pass,
-				      lcb_uint32_t timeout)
+static lcb_error_t couchbase_create(lcb_t *instance, const char *host, const char *bucket, const char *pass,
+				    lcb_uint32_t timeout, lcb_io_opt_t io)
 {
 	lcb_error_t error;                      /* couchbase command return */
 	struct lcb_create_st options;           /* init create struct */
@@ -205,6 +249,7 @@ lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const c
 	/* assign couchbase create options */
 	options.v.v0.host = host;
 	options.v.v0.bucket = bucket;
+	options.v.v0.io = io;
 
 	/* assign user and password if they were both passed */
 	if (bucket != NULL && pass != NULL) {
@@ -216,11 +261,34 @@ lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const c
 	error = lcb_create(instance, &options);
 	if (error != LCB_SUCCESS) return error;
 
-	error = lcb_cntl(*instance, LCB_CNTL_SET, LCB_CNTL_CONFIGURATION_TIMEOUT, &timeout);
-	if (error != LCB_SUCCESS) return error;
+	/* zero means use the libcouchbase default */
+	if (timeout) {
+		error = lcb_cntl(*instance, LCB_CNTL_SET, LCB_CNTL_CONFIGURATION_TIMEOUT, &timeout);
+		if (error != LCB_SUCCESS) return error;
+	}
 
 	/* initiate connection */
-	error = lcb_connect(*instance);
+	return lcb_connect(*instance);
+}
+
+/** Initialize a Couchbase connection instance
+ *
+ * Initialize all information relating to a Couchbase instance and configure available method callbacks.
+ * This function forces synchronous operation and will wait for a connection or timeout.
+ *
+ * @param instance Empty (un-allocated) Couchbase instance object.
+ * @param host       The Couchbase server or list of servers.
+ * @param bucket     The Couchbase bucket to associate with the instance.
+ * @param pass       The Couchbase bucket password (NULL if none).
+ * @param timeout    Maximum time to wait for obtaining the initial configuration.
+ * @return           Couchbase error object.
+ */
+lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const char *bucket, const char *pass,
+				      lcb_uint32_t timeout)
+{
+	lcb_error_t error;                      /* couchbase command return */
+
+	error = couchbase_create(instance, host, bucket, pass, timeout, NULL);
 	if (error != LCB_SUCCESS) return error;
 
 	/* set general method callbacks */
@@ -234,6 +302,36 @@ lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const c
 	return LCB_SUCCESS;
 }
 
+/** Initialize an asynchronous Couchbase connection instance
+ *
+ * Like #couchbase_init_connection, but all IO is performed using the passed IO table,
+ * and get and store operations complete the #couchbase_op_t they were scheduled with.
+ * Does not wait for the connection, operations scheduled before the initial
+ * configuration is received are queued by libcouchbase.
+ *
+ * @param instance Empty (un-allocated) Couchbase instance object.
+ * @param host       The Couchbase server or list of servers.
+ * @param bucket     The Couchbase bucket to associate with the instance.
+ * @param pass       The Couchbase bucket password (NULL if none).
+ * @param timeout    Maximum time to wait for obtaining the initial configuration (0 = default).
+ * @param io         IO table from #couchbase_io_alloc.
+ * @return           Couchbase error object.
+ */
+lcb_error_t couchbase_init_connection_async(lcb_t *instance, const char *host, const char *bucket, const char *pass,
+					    lcb_uint32_t timeout, lcb_io_opt_t io)
+{
+	lcb_error_t error;                      /* couchbase command return */
+
+	error = couchbase_create(instance, host, bucket, pass, timeout, io);
+	if (error != LCB_SUCCESS) return error;
+
+	/* set async method callbacks */
+	lcb_set_store_callback(*instance, couchbase_async_store_callback);
+	lcb_set_get_callback(*instance, couchbase_async_get_callback);
+
+	return LCB_SUCCESS;
+}
+
 /** Request Couchbase server statistics
  *
  * Setup and execute a request for cluster statistics and wait for the result.
@@ -355,6 +453,87 @@ lcb_error_t couchbase_get_key(lcb_t instance, const void *cookie, const char *ke
 	return error;
 }
 
+/** Schedule retrieval of a document by key from Couchbase
+ *
+ * Setup a Couchbase get request, the op's callback is called when the document
+ * has been received and parsed, or the request fails.
+ *
+ * @param  instance Couchbase connection instance from #couchbase_init_connection_async.
+ * @param  op       Operation to complete.  Must remain valid until the callback is called.
+ * @param  key      Document key to fetch.
+ * @return          Couchbase error object.  If not LCB_SUCCESS the callback will not be called.
+ */
+lcb_error_t couchbase_get_key_async(lcb_t instance, couchbase_op_t *op, const char *key)
+{
+	lcb_error_t error;                   /* couchbase command return */
+	lcb_get_cmd_t cmd;                   /* get command struct */
+	const lcb_get_cmd_t *commands[1];    /* get commands array */
+
+	/* init commands */
+	commands[0] = &cmd;
+	memset(&cmd, 0, sizeof(cmd));
+
+	/* populate command struct */
+	cmd.v.v0.key = key;
+	cmd.v.v0.nkey = strlen(cmd.v.v0.key);
+
+	/* clear cookie */
+	memset(&op->cookie, 0, sizeof(cookie_t));
+
+	/* init tokener error */
+	op->cookie.jerr = json_tokener_success;
+
+	/* create token, freed by the callback */
+	op->cookie.jtok = json_tokener_new();
+
+	/* debugging */
+	DEBUG3("scheduling fetch of document %s", key);
+
+	/* schedule get, the key is copied into the packet */
+	error = lcb_get(instance, op, 1, commands);
+	if (error != LCB_SUCCESS) {
+		json_tokener_free(op->cookie.jtok);
+		op->cookie.jtok = NULL;
+	}
+
+	/* return error */
+	return error;
+}
+
+/** Schedule storing a document by key in Couchbase
+ *
+ * Setup a Couchbase set operation, the op's callback is called when the server
+ * responds, or the request fails.
+ *
+ * @param  instance Couchbase connection instance from #couchbase_init_connection_async.
+ * @param  op       Operation to complete.  Must remain valid until the callback is called.
+ * @param  key      Document key to store in the database.
+ * @param  document Document body to store in the database.
+ * @param  expire   Expiration time for the document (0 = never)
+ * @return          Couchbase error object.  If not LCB_SUCCESS the callback will not be called.
+ */
+lcb_error_t couchbase_set_key_async(lcb_t instance, couchbase_op_t *op, const char *key, const char *document,
+				    int expire)
+{
+	lcb_store_cmd_t cmd;                /* store command stuct */
+	const lcb_store_cmd_t *commands[1]; /* store commands array */
+
+	/* init commands */
+	commands[0] = &cmd;
+	memset(&cmd, 0, sizeof(cmd));
+
+	/* populate command struct */
+	cmd.v.v0.key = key;
+	cmd.v.v0.nkey = strlen(cmd.v.v0.key);
+	cmd.v.v0.bytes = document;
+	cmd.v.v0.nbytes = strlen(cmd.v.v0.bytes);
+	cmd.v.v0.exptime = expire;
+	cmd.v.v0.operation = LCB_SET;
+
+	/* schedule store, key and document are copied into the packet */
+	return lcb_store(instance, op, 1, commands);
+}
+
 /** Query a Couchbase design document view
  *
  * Setup and execute a Couchbase view request and wait for the result.
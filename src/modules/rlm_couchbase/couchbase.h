@@ -53,6 +53,26 @@ typedef union cookie_u {
 	void *data;           //!< Non-constant pointer to data payload (@p cookie_t).
 } cookie_u;
 
+typedef struct couchbase_op couchbase_op_t;
+
+/** Called when an asynchronous operation completes
+ *
+ * @param[in] op	that completed, with @p error set to the result.
+ */
+typedef void (*couchbase_op_cb_t)(couchbase_op_t *op);
+
+/** An asynchronous get or store operation
+ *
+ * Passed as the cookie for operations scheduled on an lcb_t using the IO table
+ * from #couchbase_io_alloc.
+ */
+struct couchbase_op {
+	cookie_t		cookie;		//!< Must be first, holds the parsed document.
+	lcb_error_t		error;		//!< Result of the operation.
+	couchbase_op_cb_t	callback;	//!< Called when the operation completes.
+	void			*uctx;		//!< For use by the callback.
+};
+
 /* couchbase statistics callback */
 void couchbase_stat_callback(lcb_t instance, const void *cookie, lcb_error_t error,
 	const lcb_server_stat_resp_t *resp);
@@ -69,10 +89,24 @@ void couchbase_get_callback(lcb_t instance, const void *cookie, lcb_error_t erro
 void couchbase_http_data_callback(lcb_http_request_t request, lcb_t instance,
 	const void *cookie, lcb_error_t error, const lcb_http_resp_t *resp);
 
+/* async get and store callbacks, which complete the couchbase_op_t */
+void couchbase_async_get_callback(lcb_t instance, const void *cookie, lcb_error_t error,
+	const lcb_get_resp_t *item);
+
+void couchbase_async_store_callback(lcb_t instance, const void *cookie, lcb_storage_t operation,
+	lcb_error_t error, const lcb_store_resp_t *item);
+
 /* create a couchbase instance and connect to the cluster */
 lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const char *bucket, const char *pass,
 				      lcb_uint32_t timeout);
 
+/* create a couchbase instance which uses the passed io table, and start connecting to the cluster */
+lcb_error_t couchbase_init_connection_async(lcb_t *instance, const char *host, const char *bucket, const char *pass,
+					    lcb_uint32_t timeout, lcb_io_opt_t io);
+
+/* io table which services couchbase instances from a worker's event list */
+lcb_io_opt_t couchbase_io_alloc(TALLOC_CTX *ctx, fr_event_list_t *el);
+
 /* get server statistics */
 lcb_error_t couchbase_server_stats(lcb_t instance, const void *cookie);
 
@@ -82,6 +116,13 @@ lcb_error_t couchbase_set_key(lcb_t instance, const char *key, const char *docum
 /* pull document from couchbase by key */
 lcb_error_t couchbase_get_key(lcb_t instance, const void *cookie, const char *key);
 
+/* schedule a get, completing the op when the document arrives */
+lcb_error_t couchbase_get_key_async(lcb_t instance, couchbase_op_t *op, const char *key);
+
+/* schedule a store, completing the op when the server responds */
+lcb_error_t couchbase_set_key_async(lcb_t instance, couchbase_op_t *op, const char *key, const char *document,
+				    int expire);
+
 /* query a couchbase view via http */
 lcb_error_t couchbase_query_view(lcb_t instance, const void *cookie, const char *path, const char *post);
 
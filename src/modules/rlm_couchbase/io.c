@@ -0,0 +1,373 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_couchbase/io.c
+ * @brief libcouchbase IO plugin which runs on a worker's event list
+ *
+ * libcouchbase drives all socket IO and operation timeouts through an
+ * "event model" IO table.  By providing our own, the library never runs
+ * an event loop of its own, and instead gets called back from the worker's
+ * fr_event_list_t, the same way rlm_rest services curl multi-handles.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+#define LOG_PREFIX "rlm_couchbase - "
+
+#include <freeradius-devel/radiusd.h>
+
+#include <sys/uio.h>
+#include <libcouchbase/couchbase.h>
+
+#include "couchbase.h"
+
+/*
+ *	Maximum number of buffers we pass to readv/writev in one call,
+ *	libcouchbase handles partial reads and writes already.
+ */
+#define COUCHBASE_IO_IOV_MAX	32
+
+/** Handler signature libcouchbase uses for both socket and timer events
+ *
+ */
+typedef void (*couchbase_io_handler_t)(lcb_socket_t sock, short which, void *cb_data);
+
+/** IO table, and the event list it's bound to
+ *
+ * The lcb_io_opt_st must be first, so we can get back to the event list
+ * from the iops pointer libcouchbase passes to every function.
+ */
+typedef struct couchbase_io {
+	struct lcb_io_opt_st	iops;		//!< The table we give to libcouchbase.
+	fr_event_list_t		*el;		//!< Event list to insert events into.
+} couchbase_io_t;
+
+/** A socket libcouchbase wants to be notified about
+ *
+ */
+typedef struct couchbase_io_event {
+	couchbase_io_t		*io;		//!< IO table this event belongs to.
+	lcb_socket_t		sock;		//!< Socket we're watching, -1 if not registered.
+	short			flags;		//!< LCB_READ_EVENT and/or LCB_WRITE_EVENT.
+	couchbase_io_handler_t	handler;	//!< Called when the socket is readable/writable.
+	void			*cb_data;	//!< Passed to the handler.
+} couchbase_io_event_t;
+
+/** A timer libcouchbase uses for operation and configuration timeouts
+ *
+ */
+typedef struct couchbase_io_timer {
+	couchbase_io_t		*io;		//!< IO table this timer belongs to.
+	fr_event_timer_t const	*ev;		//!< Timer inserted into the event list.
+	couchbase_io_handler_t	handler;	//!< Called when the timer fires.
+	void			*cb_data;	//!< Passed to the handler.
+} couchbase_io_timer_t;
+
+static lcb_socket_t _couchbase_io_socket(struct lcb_io_opt_st *iops, int domain, int type, int protocol)
+{
+	int fd;
+
+	fd = socket(domain, type, protocol);
+	if (fd < 0) {
+		iops->v.v0.error = errno;
+		return INVALID_SOCKET;
+	}
+
+	if (fr_nonblock(fd) < 0) {
+		iops->v.v0.error = errno;
+		close(fd);
+		return INVALID_SOCKET;
+	}
+
+	return fd;
+}
+
+static int _couchbase_io_connect(struct lcb_io_opt_st *iops, lcb_socket_t sock,
+				 struct sockaddr const *name, unsigned int namelen)
+{
+	int ret;
+
+	ret = connect(sock, name, (socklen_t)namelen);
+	if (ret < 0) iops->v.v0.error = errno;
+
+	return ret;
+}
+
+static lcb_ssize_t _couchbase_io_recv(struct lcb_io_opt_st *iops, lcb_socket_t sock,
+				      void *buffer, lcb_size_t len, int flags)
+{
+	ssize_t ret;
+
+	ret = recv(sock, buffer, len, flags);
+	if (ret < 0) iops->v.v0.error = errno;
+
+	return ret;
+}
+
+static lcb_ssize_t _couchbase_io_send(struct lcb_io_opt_st *iops, lcb_socket_t sock,
+				      void const *msg, lcb_size_t len, int flags)
+{
+	ssize_t ret;
+
+	ret = send(sock, msg, len, flags);
+	if (ret < 0) iops->v.v0.error = errno;
+
+	return ret;
+}
+
+static lcb_ssize_t _couchbase_io_recvv(struct lcb_io_opt_st *iops, lcb_socket_t sock,
+				       struct lcb_iovec_st *iov, lcb_size_t niov)
+{
+	struct iovec	vec[COUCHBASE_IO_IOV_MAX];
+	lcb_size_t	i;
+	ssize_t		ret;
+
+	if (niov > COUCHBASE_IO_IOV_MAX) niov = COUCHBASE_IO_IOV_MAX;
+	for (i = 0; i < niov; i++) {
+		vec[i].iov_base = iov[i].iov_base;
+		vec[i].iov_len = iov[i].iov_len;
+	}
+
+	ret = readv(sock, vec, (int)niov);
+	if (ret < 0) iops->v.v0.error = errno;
+
+	return ret;
+}
+
+static lcb_ssize_t _couchbase_io_sendv(struct lcb_io_opt_st *iops, lcb_socket_t sock,
+				       struct lcb_iovec_st *iov, lcb_size_t niov)
+{
+	struct iovec	vec[COUCHBASE_IO_IOV_MAX];
+	lcb_size_t	i;
+	ssize_t		ret;
+
+	if (niov > COUCHBASE_IO_IOV_MAX) niov = COUCHBASE_IO_IOV_MAX;
+	for (i = 0; i < niov; i++) {
+		vec[i].iov_base = iov[i].iov_base;
+		vec[i].iov_len = iov[i].iov_len;
+	}
+
+	ret = writev(sock, vec, (int)niov);
+	if (ret < 0) iops->v.v0.error = errno;
+
+	return ret;
+}
+
+static void _couchbase_io_close(UNUSED struct lcb_io_opt_st *iops, lcb_socket_t sock)
+{
+	close(sock);
+}
+
+static void _couchbase_io_readable(UNUSED fr_event_list_t *el, int sock, UNUSED int flags, void *uctx)
+{
+	couchbase_io_event_t *ev = uctx;
+
+	ev->handler(sock, LCB_READ_EVENT, ev->cb_data);
+}
+
+static void _couchbase_io_writable(UNUSED fr_event_list_t *el, int sock, UNUSED int flags, void *uctx)
+{
+	couchbase_io_event_t *ev = uctx;
+
+	ev->handler(sock, LCB_WRITE_EVENT, ev->cb_data);
+}
+
+/** Let libcouchbase discover the error itself when it next reads or writes
+ *
+ */
+static void _couchbase_io_errored(UNUSED fr_event_list_t *el, int sock, UNUSED int flags,
+				  int fd_errno, void *uctx)
+{
+	couchbase_io_event_t *ev = uctx;
+
+	DEBUG3("Socket %i errored: %s", sock, fr_syserror(fd_errno));
+
+	ev->handler(sock, ev->flags, ev->cb_data);
+}
+
+static void *_couchbase_io_event_create(struct lcb_io_opt_st *iops)
+{
+	couchbase_io_t		*io = (couchbase_io_t *)iops;
+	couchbase_io_event_t	*ev;
+
+	ev = talloc_zero(io, couchbase_io_event_t);
+	if (!ev) return NULL;
+
+	ev->io = io;
+	ev->sock = INVALID_SOCKET;
+
+	return ev;
+}
+
+static void _couchbase_io_event_delete(UNUSED struct lcb_io_opt_st *iops, UNUSED lcb_socket_t sock, void *event)
+{
+	couchbase_io_event_t *ev = event;
+
+	if (ev->sock == INVALID_SOCKET) return;
+
+	if (fr_event_fd_delete(ev->io->el, ev->sock) < 0) {
+		PERROR("Failed removing events for socket %i", ev->sock);
+	}
+	ev->sock = INVALID_SOCKET;
+	ev->flags = 0;
+}
+
+static void _couchbase_io_event_destroy(struct lcb_io_opt_st *iops, void *event)
+{
+	couchbase_io_event_t *ev = event;
+
+	_couchbase_io_event_delete(iops, ev->sock, ev);
+	talloc_free(ev);
+}
+
+static int _couchbase_io_event_update(struct lcb_io_opt_st *iops, lcb_socket_t sock, void *event, short flags,
+				      void *cb_data, couchbase_io_handler_t handler)
+{
+	couchbase_io_event_t	*ev = event;
+
+	ev->handler = handler;
+	ev->cb_data = cb_data;
+
+	if ((ev->sock == sock) && (ev->flags == flags)) return 0;
+
+	if ((ev->sock != INVALID_SOCKET) && (ev->sock != sock)) _couchbase_io_event_delete(iops, ev->sock, ev);
+
+	if (!(flags & LCB_RW_EVENT)) {
+		_couchbase_io_event_delete(iops, sock, ev);
+		return 0;
+	}
+
+	if (fr_event_fd_insert(ev->io, ev->io->el, sock,
+			       (flags & LCB_READ_EVENT) ? _couchbase_io_readable : NULL,
+			       (flags & LCB_WRITE_EVENT) ? _couchbase_io_writable : NULL,
+			       _couchbase_io_errored, ev) < 0) {
+		PERROR("Failed inserting events for socket %i", sock);
+		iops->v.v0.error = EINVAL;
+		return -1;
+	}
+	ev->sock = sock;
+	ev->flags = flags;
+
+	return 0;
+}
+
+static void _couchbase_io_timer_fired(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	couchbase_io_timer_t *timer = uctx;
+
+	timer->handler(INVALID_SOCKET, 0, timer->cb_data);
+}
+
+static void *_couchbase_io_timer_create(struct lcb_io_opt_st *iops)
+{
+	couchbase_io_t		*io = (couchbase_io_t *)iops;
+	couchbase_io_timer_t	*timer;
+
+	timer = talloc_zero(io, couchbase_io_timer_t);
+	if (!timer) return NULL;
+
+	timer->io = io;
+
+	return timer;
+}
+
+static void _couchbase_io_timer_delete(UNUSED struct lcb_io_opt_st *iops, void *t)
+{
+	couchbase_io_timer_t *timer = t;
+
+	(void) fr_event_timer_delete(timer->io->el, &timer->ev);
+}
+
+static void _couchbase_io_timer_destroy(struct lcb_io_opt_st *iops, void *t)
+{
+	_couchbase_io_timer_delete(iops, t);
+	talloc_free(t);
+}
+
+static int _couchbase_io_timer_update(struct lcb_io_opt_st *iops, void *t, lcb_uint32_t usec,
+				      void *cb_data, couchbase_io_handler_t handler)
+{
+	couchbase_io_timer_t	*timer = t;
+	struct timeval		now, to_add, when;
+
+	timer->handler = handler;
+	timer->cb_data = cb_data;
+
+	gettimeofday(&now, NULL);
+	to_add.tv_sec = usec / 1000000;
+	to_add.tv_usec = usec % 1000000;
+	fr_timeval_add(&when, &now, &to_add);
+
+	if (fr_event_timer_insert(timer, timer->io->el, &timer->ev, &when, _couchbase_io_timer_fired, timer) < 0) {
+		PERROR("Failed inserting timer");
+		iops->v.v0.error = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/** The worker's event loop is always running, so there's nothing to start or stop
+ *
+ */
+static void _couchbase_io_loop_noop(UNUSED struct lcb_io_opt_st *iops)
+{
+}
+
+/** Allocate an IO table which inserts libcouchbase's events into a worker's event list
+ *
+ * Operations scheduled with an lcb_t created with this table return immediately.
+ * Writes are made when the socket becomes writable, so all operations scheduled
+ * during a single pass of the event loop are flushed to the server together.
+ *
+ * @param[in] ctx	to allocate the IO table in.  Must outlive the lcb_t.
+ * @param[in] el	to insert socket and timer events into.
+ * @return
+ *	- IO table to pass to #couchbase_init_connection_async.
+ *	- NULL on error.
+ */
+lcb_io_opt_t couchbase_io_alloc(TALLOC_CTX *ctx, fr_event_list_t *el)
+{
+	couchbase_io_t	*io;
+
+	io = talloc_zero(ctx, couchbase_io_t);
+	if (!io) return NULL;
+
+	io->el = el;
+
+	io->iops.version = 0;
+	io->iops.v.v0.cookie = io;
+	io->iops.v.v0.socket = _couchbase_io_socket;
+	io->iops.v.v0.connect = _couchbase_io_connect;
+	io->iops.v.v0.recv = _couchbase_io_recv;
+	io->iops.v.v0.send = _couchbase_io_send;
+	io->iops.v.v0.recvv = _couchbase_io_recvv;
+	io->iops.v.v0.sendv = _couchbase_io_sendv;
+	io->iops.v.v0.close = _couchbase_io_close;
+	io->iops.v.v0.create_timer = _couchbase_io_timer_create;
+	io->iops.v.v0.destroy_timer = _couchbase_io_timer_destroy;
+	io->iops.v.v0.delete_timer = _couchbase_io_timer_delete;
+	io->iops.v.v0.update_timer = _couchbase_io_timer_update;
+	io->iops.v.v0.create_event = _couchbase_io_event_create;
+	io->iops.v.v0.destroy_event = _couchbase_io_event_destroy;
+	io->iops.v.v0.update_event = _couchbase_io_event_update;
+	io->iops.v.v0.delete_event = _couchbase_io_event_delete;
+	io->iops.v.v0.stop_event_loop = _couchbase_io_loop_noop;
+	io->iops.v.v0.run_event_loop = _couchbase_io_loop_noop;
+
+	return &io->iops;
+}
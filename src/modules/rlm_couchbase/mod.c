@@ -372,9 +372,10 @@ void *mod_json_object_to_value_pairs(json_object *json, const char *section, REQ
 
 /** Convert value pairs to json objects
  *
- * Take the passed value pair and convert it to a json-c JSON object.
- * This code is heavily based on the fr_json_from_pair() function
- * from src/lib/print.c.
+ * Take the passed value pair and convert it to a json-c JSON object,
+ * using the same conversion as the rest of the JSON encoders.
+ *
+ * @see fr_json_object_from_pair
  *
  * @param  request The request object.
  * @param  vp      The value pair to convert.
@@ -382,85 +383,10 @@ void *mod_json_object_to_value_pairs(json_object *json, const char *section, REQ
  */
 json_object *mod_value_pair_to_json_object(REQUEST *request, VALUE_PAIR *vp)
 {
-	char value[255];    /* radius attribute value */
-
-	/* add this attribute/value pair to our json output */
-	if (!vp->da->flags.has_tag) {
-		unsigned int i;
-
-		switch (vp->vp_type) {
-		case FR_TYPE_UINT32:
-			i = vp->vp_uint32;
-			goto print_int;
-
-		case FR_TYPE_UINT16:
-			i = vp->vp_uint16;
-			goto print_int;
-
-		case FR_TYPE_UINT8:
-			i = vp->vp_uint8;
-
-		print_int:
-			/* skip if we have flags */
-			if (vp->da->flags.has_value) break;
-#ifdef HAVE_JSON_OBJECT_NEW_INT64
-			/* debug */
-			RDEBUG3("creating new int64 for unsigned 32 bit int/byte/short '%s'", vp->da->name);
-			/* return as 64 bit int - JSON spec does not support unsigned ints */
-			return json_object_new_int64(i);
-#else
-			/* debug */
-			RDEBUG3("creating new int for unsigned 32 bit int/byte/short '%s'", vp->da->name);
-			/* return as 64 bit int - JSON spec does not support unsigned ints */
-			return json_object_new_int(i);
-#endif
-
-		case FR_TYPE_INT32:
-#ifdef HAVE_JSON_OBJECT_NEW_INT64
-			/* debug */
-			RDEBUG3("creating new int64 for signed 32 bit integer '%s'", vp->da->name);
-			/* return as 64 bit int - json-c represents all ints as 64 bits internally */
-			return json_object_new_int64(vp->vp_int32);
-#else
-			RDEBUG3("creating new int for signed 32 bit integer '%s'", vp->da->name);
-			/* return as signed int */
-			return json_object_new_int(vp->vp_int32);
-#endif
-
-		case FR_TYPE_UINT64:
-#ifdef HAVE_JSON_OBJECT_NEW_INT64
-			/* debug */
-			RDEBUG3("creating new int64 for 64 bit integer '%s'", vp->da->name);
-			/* return as 64 bit int - because it is a 64 bit int */
-			return json_object_new_int64(vp->vp_uint64);
-#else
-			/* warning */
-			RWARN("skipping 64 bit integer attribute '%s' - please upgrade json-c to 0.10+", vp->da->name);
-			break;
-#endif
-
-		default:
-			/* silence warnings - do nothing */
-		break;
-		}
-	}
+	/* debug */
+	RDEBUG3("converting '%s' to json", vp->da->name);
 
-	/* keep going if not set above */
-	switch (vp->vp_type) {
-	case FR_TYPE_STRING:
-		/* debug */
-		RDEBUG3("assigning string '%s' as string", vp->da->name);
-		/* return string value */
-		return json_object_new_string(vp->vp_strvalue);
-
-	default:
-		/* debug */
-		RDEBUG3("assigning unhandled '%s' as string", vp->da->name);
-		/* get standard value */
-		fr_pair_value_snprint(value, sizeof(value), vp, 0);
-		/* return string value from above */
-		return json_object_new_string(value);
-	}
+	return fr_json_object_from_pair(vp);
 }
 
 /** Ensure accounting documents always contain a valid timestamp
@@ -63,6 +63,19 @@ typedef struct rlm_couchbase_t {
 	fr_pool_t	*pool;			//!< Connection pool.
 } rlm_couchbase_t;
 
+/** Per-thread instance data
+ *
+ * Each worker has its own Couchbase connection instance, serviced by the
+ * worker's event list, which is used for the asynchronous authorize and
+ * accounting operations.
+ */
+typedef struct rlm_couchbase_thread_t {
+	rlm_couchbase_t const	*inst;			//!< Instance of rlm_couchbase.
+	fr_event_list_t		*el;			//!< This thread's event list.
+	lcb_io_opt_t		io;			//!< IO table inserting events into el.
+	lcb_t			cb_inst;		//!< Couchbase connection instance.
+} rlm_couchbase_thread_t;
+
 /** Couchbase instance specific information
  *
  * This struct contains the Couchbase connection handle as well as a
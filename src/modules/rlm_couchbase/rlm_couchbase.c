@@ -65,56 +65,99 @@ static const CONF_PARSER module_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
-/** Handle authorization requests using Couchbase document data
+/** State for a request waiting on an asynchronous Couchbase operation
  *
- * Attempt to fetch the document assocaited with the requested user by
- * using the deterministic key defined in the configuration.  When a valid
- * document is found it will be parsed and the containing value pairs will be
- * injected into the request.
+ * Allocated in the thread's context, not the request's, so that if the request
+ * is cancelled, the operation can still complete safely.
+ */
+typedef struct rlm_couchbase_ctx_t {
+	couchbase_op_t		op;			//!< The operation in progress.
+	REQUEST			*request;		//!< Request to resume, NULL if it was cancelled.
+	char			*dockey;		//!< Document key.
+	int			status;			//!< Accounting status type.
+	bool			docfound;		//!< Whether we found an existing document.
+} rlm_couchbase_ctx_t;
+
+/** Release the parsed document when the context is freed
  *
- * @param instance	The module instance.
- * @param thread	specific data.
- * @param request	The authorization request.
- * @return Operation status (#rlm_rcode_t).
  */
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+static int _couchbase_ctx_free(rlm_couchbase_ctx_t *ctx)
 {
-	rlm_couchbase_t const *inst = instance;       /* our module instance */
-	rlm_couchbase_handle_t *handle = NULL;  /* connection pool handle */
-	char buffer[MAX_KEY_SIZE];
-	char const *dockey;            		/* our document key */
-	lcb_error_t cb_error = LCB_SUCCESS;     /* couchbase error holder */
-	rlm_rcode_t rcode = RLM_MODULE_OK;      /* return code */
-	ssize_t slen;
+	if (ctx->op.cookie.jobj) {
+		json_object_put(ctx->op.cookie.jobj);
+		ctx->op.cookie.jobj = NULL;
+	}
+	if (ctx->op.cookie.jtok) {
+		json_tokener_free(ctx->op.cookie.jtok);
+		ctx->op.cookie.jtok = NULL;
+	}
 
-	/* assert packet as not null */
-	rad_assert(request->packet != NULL);
+	return 0;
+}
 
-	/* attempt to build document key */
-	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, inst->user_key, NULL, NULL);
-	if (slen < 0) return RLM_MODULE_FAIL;
-	if ((dockey == buffer) && is_truncated((size_t)slen, sizeof(buffer))) {
-		REDEBUG("Key too long, expected < " STRINGIFY(sizeof(buffer)) " bytes, got %zi bytes", slen);
-		return RLM_MODULE_FAIL;
+/** Operation completed, mark the request as runnable, or discard the result
+ *
+ */
+static void _couchbase_op_done(couchbase_op_t *op)
+{
+	rlm_couchbase_ctx_t *ctx = op->uctx;
+
+	if (!ctx->request) {
+		talloc_free(ctx);
+		return;
 	}
 
-	/* get handle */
-	handle = fr_pool_connection_get(inst->pool, request);
+	unlang_resumable(ctx->request);
+}
 
-	/* check handle */
-	if (!handle) return RLM_MODULE_FAIL;
+/** Allocate a context for an asynchronous operation
+ *
+ */
+static rlm_couchbase_ctx_t *couchbase_ctx_alloc(rlm_couchbase_thread_t *t, REQUEST *request, char const *dockey)
+{
+	rlm_couchbase_ctx_t *ctx;
 
-	/* set couchbase instance */
-	lcb_t cb_inst = handle->handle;
+	MEM(ctx = talloc_zero(t, rlm_couchbase_ctx_t));
+	talloc_set_destructor(ctx, _couchbase_ctx_free);
+	ctx->request = request;
+	ctx->dockey = talloc_strdup(ctx, dockey);
+	ctx->op.callback = _couchbase_op_done;
+	ctx->op.uctx = ctx;
 
-	/* set cookie */
-	cookie_t *cookie = handle->cookie;
+	return ctx;
+}
 
-	/* fetch document */
-	cb_error = couchbase_get_key(cb_inst, cookie, dockey);
+/** Request was cancelled, free the context when the operation completes
+ *
+ * libcouchbase doesn't allow operations to be cancelled, so we just
+ * unlink the request and let #_couchbase_op_done clean up.
+ */
+static void mod_signal(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+		       void *rctx, fr_state_action_t action)
+{
+	rlm_couchbase_ctx_t *ctx = rctx;
+
+	if (action != FR_ACTION_DONE) return;
+
+	ctx->request = NULL;
+}
+
+/** Apply the user document fetched by mod_authorize
+ *
+ * @param request	The authorization request.
+ * @param instance	The module instance.
+ * @param thread	specific data.
+ * @param rctx		The #rlm_couchbase_ctx_t for the fetch.
+ * @return Operation status (#rlm_rcode_t).
+ */
+static rlm_rcode_t mod_authorize_resume(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *rctx)
+{
+	rlm_couchbase_ctx_t	*ctx = rctx;
+	cookie_t		*cookie = &ctx->op.cookie;
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
 
 	/* check error */
-	if (cb_error != LCB_SUCCESS || !cookie->jobj) {
+	if (ctx->op.error != LCB_SUCCESS || !cookie->jobj) {
 		/* log error */
 		RERROR("failed to fetch document or parse return");
 		/* set return */
@@ -132,105 +175,111 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 	/* inject reply value pairs defined in this json oblect */
 	mod_json_object_to_value_pairs(cookie->jobj, "reply", request);
 
-	finish:
-
-	/* free json object */
-	if (cookie->jobj) {
-		json_object_put(cookie->jobj);
-		cookie->jobj = NULL;
-	}
-
-	/* release handle */
-	if (handle) {
-		fr_pool_connection_release(inst->pool, request, handle);
-	}
+finish:
+	/* free context and json object */
+	talloc_free(ctx);
 
 	/* return */
 	return rcode;
 }
 
-#ifdef WITH_ACCOUNTING
-/** Write accounting data to Couchbase documents
+/** Handle authorization requests using Couchbase document data
  *
- * Handle accounting requests and store the associated data into JSON documents
- * in couchbase mapping attribute names to JSON element names per the module configuration.
+ * Attempt to fetch the document assocaited with the requested user by
+ * using the deterministic key defined in the configuration.  When a valid
+ * document is found it will be parsed and the containing value pairs will be
+ * injected into the request.
  *
- * When an existing document already exists for the same accounting section the new attributes
- * will be merged with the currently existing data.  When conflicts arrise the new attribute
- * value will replace or be added to the existing value.
+ * The fetch is scheduled on this thread's Couchbase instance, and the request
+ * yields until the document arrives.
  *
  * @param instance	The module instance.
  * @param thread	specific data.
- * @param request	The accounting request object.
+ * @param request	The authorization request.
  * @return Operation status (#rlm_rcode_t).
  */
-static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request)
 {
 	rlm_couchbase_t const *inst = instance;       /* our module instance */
-	rlm_couchbase_handle_t *handle = NULL;  /* connection pool handle */
-	rlm_rcode_t rcode = RLM_MODULE_OK;      /* return code */
-	VALUE_PAIR *vp;                         /* radius value pair linked list */
+	rlm_couchbase_thread_t *t = thread;     /* our thread instance */
+	rlm_couchbase_ctx_t *ctx;               /* async operation context */
 	char buffer[MAX_KEY_SIZE];
-	char const *dockey;			/* our document key */
-	char document[MAX_VALUE_SIZE];          /* our document body */
-	char element[MAX_KEY_SIZE];             /* mapped radius attribute to element name */
-	int status = 0;                         /* account status type */
-	int docfound = 0;                       /* document found toggle */
+	char const *dockey;            		/* our document key */
 	lcb_error_t cb_error = LCB_SUCCESS;     /* couchbase error holder */
 	ssize_t slen;
 
 	/* assert packet as not null */
 	rad_assert(request->packet != NULL);
 
-	/* sanity check */
-	if ((vp = fr_pair_find_by_num(request->packet->vps, 0, FR_ACCT_STATUS_TYPE, TAG_ANY)) == NULL) {
-		/* log debug */
-		RDEBUG("could not find status type in packet");
-		/* return */
-		return RLM_MODULE_NOOP;
+	/* attempt to build document key */
+	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, inst->user_key, NULL, NULL);
+	if (slen < 0) return RLM_MODULE_FAIL;
+	if ((dockey == buffer) && is_truncated((size_t)slen, sizeof(buffer))) {
+		REDEBUG("Key too long, expected < " STRINGIFY(sizeof(buffer)) " bytes, got %zi bytes", slen);
+		return RLM_MODULE_FAIL;
 	}
 
-	/* set status */
-	status = vp->vp_uint32;
+	ctx = couchbase_ctx_alloc(t, request, dockey);
 
-	/* acknowledge the request but take no action */
-	if (status == FR_STATUS_ACCOUNTING_ON || status == FR_STATUS_ACCOUNTING_OFF) {
-		/* log debug */
-		RDEBUG("handling accounting on/off request without action");
-		/* return */
-		return RLM_MODULE_OK;
+	/* schedule fetch of document */
+	cb_error = couchbase_get_key_async(t->cb_inst, &ctx->op, ctx->dockey);
+	if (cb_error != LCB_SUCCESS) {
+		RERROR("failed to fetch document (%s): %s (0x%x)", dockey, lcb_strerror(NULL, cb_error), cb_error);
+		talloc_free(ctx);
+		return RLM_MODULE_FAIL;
 	}
 
-	/* get handle */
-	handle = fr_pool_connection_get(inst->pool, request);
+	return unlang_module_yield(request, mod_authorize_resume, mod_signal, ctx);
+}
 
-	/* check handle */
-	if (!handle) return RLM_MODULE_FAIL;
+#ifdef WITH_ACCOUNTING
+/** Check the result of storing the accounting document
+ *
+ * @param request	The accounting request object.
+ * @param instance	The module instance.
+ * @param thread	specific data.
+ * @param rctx		The #rlm_couchbase_ctx_t for the store.
+ * @return Operation status (#rlm_rcode_t).
+ */
+static rlm_rcode_t mod_accounting_store_resume(REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+					       void *rctx)
+{
+	rlm_couchbase_ctx_t	*ctx = rctx;
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
 
-	/* set couchbase instance */
-	lcb_t cb_inst = handle->handle;
+	/* check return */
+	if (ctx->op.error != LCB_SUCCESS) {
+		RERROR("failed to store document (%s): %s (0x%x)", ctx->dockey,
+		       lcb_strerror(NULL, ctx->op.error), ctx->op.error);
+	}
 
-	/* set cookie */
-	cookie_t *cookie = handle->cookie;
+	talloc_free(ctx);
 
-	/* attempt to build document key */
-	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, inst->acct_key, NULL, NULL);
-	if (slen < 0) {
-		rcode = RLM_MODULE_FAIL;
-		goto finish;
-	}
-	if ((dockey == buffer) && is_truncated((size_t)slen, sizeof(buffer))) {
-		REDEBUG("Key too long, expected < " STRINGIFY(sizeof(buffer)) " bytes, got %zi bytes", slen);
-		rcode = RLM_MODULE_FAIL;
-		/* return */
-		goto finish;
-	}
+	return rcode;
+}
 
-	/* attempt to fetch document */
-	cb_error = couchbase_get_key(cb_inst, cookie, dockey);
+/** Merge the accounting data into the fetched document, and schedule a store
+ *
+ * @param request	The accounting request object.
+ * @param instance	The module instance.
+ * @param thread	specific data.
+ * @param rctx		The #rlm_couchbase_ctx_t for the fetch.
+ * @return Operation status (#rlm_rcode_t).
+ */
+static rlm_rcode_t mod_accounting_fetch_resume(REQUEST *request, void *instance, void *thread, void *rctx)
+{
+	rlm_couchbase_t const *inst = instance;       /* our module instance */
+	rlm_couchbase_thread_t *t = thread;     /* our thread instance */
+	rlm_couchbase_ctx_t *ctx = rctx;        /* async operation context */
+	cookie_t *cookie = &ctx->op.cookie;     /* parsed document */
+	rlm_rcode_t rcode = RLM_MODULE_OK;      /* return code */
+	VALUE_PAIR *vp;                         /* radius value pair linked list */
+	char document[MAX_VALUE_SIZE];          /* our document body */
+	char element[MAX_KEY_SIZE];             /* mapped radius attribute to element name */
+	lcb_error_t cb_error = LCB_SUCCESS;     /* couchbase error holder */
 
 	/* check error and object */
-	if (cb_error != LCB_SUCCESS || cookie->jerr != json_tokener_success || !cookie->jobj) {
+	if (ctx->op.error != LCB_SUCCESS || cookie->jerr != json_tokener_success || !cookie->jobj) {
 		/* log error */
 		RERROR("failed to execute get request or parse returned json object");
 		/* free and reset json object */
@@ -241,13 +290,13 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 	/* check cookie json object */
 	} else if (cookie->jobj) {
 		/* set doc found */
-		docfound = 1;
+		ctx->docfound = true;
 		/* debugging */
 		RDEBUG3("parsed json body from couchbase: %s", json_object_to_json_string(cookie->jobj));
 	}
 
 	/* start json document if needed */
-	if (docfound != 1) {
+	if (!ctx->docfound) {
 		/* debugging */
 		RDEBUG("no existing document found - creating new json document");
 		/* create new json object */
@@ -260,7 +309,7 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 	}
 
 	/* status specific replacements for start/stop time */
-	switch (status) {
+	switch (ctx->status) {
 	case FR_STATUS_START:
 		/* add start time */
 		if ((vp = fr_pair_find_by_num(request->packet->vps, 0, FR_EVENT_TIMESTAMP, TAG_ANY)) != NULL) {
@@ -315,30 +364,102 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 	}
 
 	/* debugging */
-	RDEBUG3("setting '%s' => '%s'", dockey, document);
+	RDEBUG3("setting '%s' => '%s'", ctx->dockey, document);
 
-	/* store document/key in couchbase */
-	cb_error = couchbase_set_key(cb_inst, dockey, document, inst->expire);
+	/* free and reset json object, the document has been serialised */
+	json_object_put(cookie->jobj);
+	cookie->jobj = NULL;
 
-	/* check return */
+	/* schedule store of document/key in couchbase */
+	cb_error = couchbase_set_key_async(t->cb_inst, &ctx->op, ctx->dockey, document, inst->expire);
 	if (cb_error != LCB_SUCCESS) {
-		RERROR("failed to store document (%s): %s (0x%x)", dockey, lcb_strerror(NULL, cb_error), cb_error);
+		RERROR("failed to store document (%s): %s (0x%x)", ctx->dockey, lcb_strerror(NULL, cb_error), cb_error);
+		goto finish;
 	}
 
+	return unlang_module_yield(request, mod_accounting_store_resume, mod_signal, ctx);
+
 finish:
-	/* free and reset json object */
-	if (cookie->jobj) {
-		json_object_put(cookie->jobj);
-		cookie->jobj = NULL;
+	/* free context and json object */
+	talloc_free(ctx);
+
+	/* return */
+	return rcode;
+}
+
+/** Write accounting data to Couchbase documents
+ *
+ * Handle accounting requests and store the associated data into JSON documents
+ * in couchbase mapping attribute names to JSON element names per the module configuration.
+ *
+ * When an existing document already exists for the same accounting section the new attributes
+ * will be merged with the currently existing data.  When conflicts arrise the new attribute
+ * value will replace or be added to the existing value.
+ *
+ * Both the fetch of the existing document and the store of the merged document are
+ * scheduled on this thread's Couchbase instance, and the request yields while they're
+ * in progress.
+ *
+ * @param instance	The module instance.
+ * @param thread	specific data.
+ * @param request	The accounting request object.
+ * @return Operation status (#rlm_rcode_t).
+ */
+static rlm_rcode_t mod_accounting(void *instance, void *thread, REQUEST *request)
+{
+	rlm_couchbase_t const *inst = instance;       /* our module instance */
+	rlm_couchbase_thread_t *t = thread;     /* our thread instance */
+	rlm_couchbase_ctx_t *ctx;               /* async operation context */
+	VALUE_PAIR *vp;                         /* radius value pair linked list */
+	char buffer[MAX_KEY_SIZE];
+	char const *dockey;			/* our document key */
+	int status = 0;                         /* account status type */
+	lcb_error_t cb_error = LCB_SUCCESS;     /* couchbase error holder */
+	ssize_t slen;
+
+	/* assert packet as not null */
+	rad_assert(request->packet != NULL);
+
+	/* sanity check */
+	if ((vp = fr_pair_find_by_num(request->packet->vps, 0, FR_ACCT_STATUS_TYPE, TAG_ANY)) == NULL) {
+		/* log debug */
+		RDEBUG("could not find status type in packet");
+		/* return */
+		return RLM_MODULE_NOOP;
 	}
 
-	/* release our connection handle */
-	if (handle) {
-		fr_pool_connection_release(inst->pool, request, handle);
+	/* set status */
+	status = vp->vp_uint32;
+
+	/* acknowledge the request but take no action */
+	if (status == FR_STATUS_ACCOUNTING_ON || status == FR_STATUS_ACCOUNTING_OFF) {
+		/* log debug */
+		RDEBUG("handling accounting on/off request without action");
+		/* return */
+		return RLM_MODULE_OK;
 	}
 
-	/* return */
-	return rcode;
+	/* attempt to build document key */
+	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, inst->acct_key, NULL, NULL);
+	if (slen < 0) return RLM_MODULE_FAIL;
+	if ((dockey == buffer) && is_truncated((size_t)slen, sizeof(buffer))) {
+		REDEBUG("Key too long, expected < " STRINGIFY(sizeof(buffer)) " bytes, got %zi bytes", slen);
+		/* return */
+		return RLM_MODULE_FAIL;
+	}
+
+	ctx = couchbase_ctx_alloc(t, request, dockey);
+	ctx->status = status;
+
+	/* schedule fetch of existing document */
+	cb_error = couchbase_get_key_async(t->cb_inst, &ctx->op, ctx->dockey);
+	if (cb_error != LCB_SUCCESS) {
+		/* we'll create a new document */
+		ctx->op.error = cb_error;
+		return mod_accounting_fetch_resume(request, instance, thread, ctx);
+	}
+
+	return unlang_module_yield(request, mod_accounting_fetch_resume, mod_signal, ctx);
 }
 #endif
 
@@ -456,6 +577,61 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+/** Create this thread's Couchbase instance
+ *
+ * @param conf		section containing the configuration of this module instance.
+ * @param instance	of rlm_couchbase_t.
+ * @param el		The event list serviced by this thread.
+ * @param thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_couchbase_t const	*inst = instance;
+	rlm_couchbase_thread_t	*t = thread;
+	lcb_error_t		cb_error;
+
+	t->inst = inst;
+	t->el = el;
+
+	t->io = couchbase_io_alloc(t, el);
+	if (!t->io) {
+		ERROR("failed to allocate couchbase io table");
+		return -1;
+	}
+
+	cb_error = couchbase_init_connection_async(&t->cb_inst, inst->server, inst->bucket, inst->password,
+						   0, t->io);
+	if (cb_error != LCB_SUCCESS) {
+		ERROR("failed to initiate couchbase connection: %s (0x%x)",
+		      lcb_strerror(NULL, cb_error), cb_error);
+		if (t->cb_inst) {
+			lcb_destroy(t->cb_inst);
+			t->cb_inst = NULL;
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Destroy this thread's Couchbase instance
+ *
+ * @param thread	specific data.
+ * @return 0.
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_couchbase_thread_t	*t = thread;
+
+	if (t->cb_inst) lcb_destroy(t->cb_inst);
+	t->cb_inst = NULL;
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	INFO("libcouchbase version: %s", lcb_get_version(NULL));
@@ -476,6 +652,9 @@ rad_module_t rlm_couchbase = {
 	.load		= mod_load,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_couchbase_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 #ifdef WITH_ACCOUNTING
@@ -27,6 +27,8 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/reload.h>
+#include <freeradius-devel/mapfile.h>
 
 #include <freeradius-devel/map_proc.h>
 
@@ -46,6 +48,8 @@ typedef struct rlm_csv_t {
 	char const	*delimiter;
 	char const	*header;
 	char const	*key;
+	struct timeval	reload_interval;
+	bool		mmap;		//!< Look entries up in the mapped file, instead of a tree.
 
 	int		num_fields;
 	int		used_fields;
@@ -53,7 +57,7 @@ typedef struct rlm_csv_t {
 
 	char const     	**field_names;
 	int		*field_offsets; /* field X from the file maps to array entry Y here */
-	rbtree_t	*tree;
+	fr_reload_t	*reload;	//!< Gives us the current tree of entries, or index.
 } rlm_csv_t;
 
 typedef struct rlm_csv_entry_t {
@@ -70,6 +74,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("delimiter", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_NOT_EMPTY, rlm_csv_t, delimiter), .dflt = "," },
 	{ FR_CONF_OFFSET("header", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_NOT_EMPTY, rlm_csv_t, header) },
 	{ FR_CONF_OFFSET("key_field", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_NOT_EMPTY, rlm_csv_t, key) },
+	{ FR_CONF_OFFSET("reload_interval", FR_TYPE_TIMEVAL, rlm_csv_t, reload_interval), .dflt = "0" },
+	{ FR_CONF_OFFSET("mmap", FR_TYPE_BOOL, rlm_csv_t, mmap), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -84,7 +90,7 @@ static int csv_entry_cmp(void const *one, void const *two)
 /*
  *	Allow for quotation marks.
  */
-static bool buf2entry(rlm_csv_t *inst, char *buf, char **out)
+static bool buf2entry(rlm_csv_t const *inst, char *buf, char **out)
 {
 	char *p, *q;
 
@@ -155,25 +161,28 @@ static bool buf2entry(rlm_csv_t *inst, char *buf, char **out)
 /*
  *	Convert a buffer to a CSV entry
  */
-static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buffer)
+static rlm_csv_entry_t *csv_entry_parse(TALLOC_CTX *ctx, rlm_csv_t const *inst, char const *filename,
+					int lineno, char *buffer)
 {
 	rlm_csv_entry_t *e;
 	int i;
 	char *p, *q;
 
-	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(inst->tree, uint8_t,
-						     sizeof(*e) + inst->used_fields + sizeof(e->data[0])));
+	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(ctx, uint8_t,
+						     sizeof(*e) + inst->used_fields * sizeof(e->data[0])));
 
 	for (p = buffer, i = 0; p != NULL; p = q, i++) {
 		if (!buf2entry(inst, p, &q)) {
-			cf_log_err(conf, "Malformed entry in file %s line %d", inst->filename, lineno);
+			ERROR("Malformed entry in file %s line %d", filename, lineno);
+			talloc_free(e);
 			return NULL;
 		}
 
 		if (q) *(q++) = '\0';
 
 		if (i >= inst->num_fields) {
-			cf_log_err(conf, "Too many fields at file %s line %d", inst->filename, lineno);
+			ERROR("Too many fields at file %s line %d", filename, lineno);
+			talloc_free(e);
 			return NULL;
 		}
 
@@ -194,22 +203,160 @@ static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno
 	}
 
 	if (i < inst->num_fields) {
-		cf_log_err(conf, "Too few fields at file %s line %d (%d < %d)", inst->filename, lineno, i, inst->num_fields);
+		ERROR("Too few fields at file %s line %d (%d < %d)", filename, lineno, i, inst->num_fields);
+		talloc_free(e);
 		return NULL;
 	}
 
+	return e;
+}
+
+/*
+ *	Convert a buffer to a CSV entry, and add it to the tree
+ */
+static rlm_csv_entry_t *file2csv(rlm_csv_t const *inst, rbtree_t *tree, char const *filename,
+				  int lineno, char *buffer)
+{
+	rlm_csv_entry_t *e;
+
+	e = csv_entry_parse(tree, inst, filename, lineno, buffer);
+	if (!e) return NULL;
+
 	/*
 	 *	FIXME: Allow duplicate keys later.
 	 */
-	if (!rbtree_insert(inst->tree, e)) {
-		cf_log_err(conf, "Failed inserting entry for filename %s line %d: duplicate entry",
-			      inst->filename, lineno);
+	if (!rbtree_insert(tree, e)) {
+		ERROR("Failed inserting entry for filename %s line %d: duplicate entry", filename, lineno);
 		return NULL;
 	}
 
 	return e;
 }
 
+/** Find the key of one line of the mapped file
+ *
+ * The whole line is parsed, so that malformed files are rejected when
+ * they're read, as they are without "mmap".
+ */
+static int csv_mapfile_key(fr_mapfile_t *mf, char const *line, size_t len, uint64_t lineno, void *uctx)
+{
+	rlm_csv_t const	*inst = uctx;
+	rlm_csv_entry_t	*e;
+	char		*buffer;
+
+	if (!len) return 0;
+
+	MEM(buffer = talloc_bstrndup(NULL, line, len));
+
+	e = csv_entry_parse(buffer, inst, inst->filename, lineno, buffer);
+	if (!e) {
+		talloc_free(buffer);
+		return -1;
+	}
+
+	fr_mapfile_add(mf, e->key, strlen(e->key));
+	talloc_free(buffer);
+
+	return 0;
+}
+
+/** Find the first line of the mapped file which has the key
+ *
+ * @return the entry, allocated in ctx, or NULL if there isn't one.
+ */
+static rlm_csv_entry_t *csv_mapfile_find(TALLOC_CTX *ctx, rlm_csv_t const *inst, fr_mapfile_t const *mf,
+					 char const *key)
+{
+	fr_mapfile_cursor_t	cursor;
+	char const		*line;
+	size_t			len;
+
+	for (line = fr_mapfile_find(mf, &cursor, key, strlen(key), &len);
+	     line;
+	     line = fr_mapfile_next(mf, &cursor, &len)) {
+		rlm_csv_entry_t	*e;
+		char		*buffer;
+
+		/*
+		 *	Different keys can have the same hash, so
+		 *	check the key, too.
+		 */
+		MEM(buffer = talloc_bstrndup(ctx, line, len));
+		e = csv_entry_parse(buffer, inst, inst->filename, 0, buffer);
+		if (!e || (strcmp(e->key, key) != 0)) {
+			talloc_free(buffer);
+			continue;
+		}
+
+		/*
+		 *	The fields are copies, so the line isn't needed.
+		 */
+		(void) talloc_steal(ctx, e);
+		talloc_free(buffer);
+
+		return e;
+	}
+
+	return NULL;
+}
+
+/** Read the CSV file into a tree of entries
+ *
+ * Called when the module is instantiated, and from the reload thread.
+ */
+static void *csv_load(TALLOC_CTX *ctx, char const *filename, void *uctx, uint64_t *entries)
+{
+	rlm_csv_t const	*inst = uctx;
+	rbtree_t	*tree;
+	FILE		*fp;
+	int		lineno;
+	char		buffer[8192];
+
+	if (inst->mmap) {
+		fr_mapfile_t *mf;
+
+		mf = fr_mapfile_alloc(ctx, filename, csv_mapfile_key, uctx);
+		if (!mf) {
+			PERROR("Failed indexing %s", filename);
+			return NULL;
+		}
+
+		*entries = fr_mapfile_num_keys(mf);
+
+		return mf;
+	}
+
+	tree = rbtree_create(ctx, csv_entry_cmp, NULL, 0);
+	if (!tree) return NULL;
+
+	/*
+	 *	Read the file line by line.
+	 */
+	fp = fopen(filename, "r");
+	if (!fp) {
+		ERROR("Error opening filename %s: %s", filename, strerror(errno));
+		talloc_free(tree);
+		return NULL;
+	}
+
+	lineno = 1;
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		if (!file2csv(inst, tree, filename, lineno, buffer)) {
+			fclose(fp);
+			talloc_free(tree);
+			return NULL;
+		}
+
+		lineno++;
+	}
+
+	fclose(fp);
+
+	*entries = rbtree_num_elements(tree);
+
+	return tree;
+}
+
 
 static int fieldname2offset(rlm_csv_t *inst, char const *field_name)
 {
@@ -276,9 +423,6 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	char const *p;
 	char *q;
 	char *header;
-	FILE *fp;
-	int lineno;
-	char buffer[8192];
 
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
@@ -365,37 +509,42 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
-	inst->tree = rbtree_create(inst, csv_entry_cmp, NULL, 0);
-	if (!inst->tree) goto oom;
+	if (timerisset(&inst->reload_interval)) {
+		FR_TIMEVAL_BOUND_CHECK("reload_interval", &inst->reload_interval, >=, 1, 0);
+		FR_TIMEVAL_BOUND_CHECK("reload_interval", &inst->reload_interval, <=, 86400, 0);
+	}
 
 	/*
-	 *	Read the file line by line.
+	 *	And register the map function.
 	 */
-	fp = fopen(inst->filename, "r");
-	if (!fp) {
-		cf_log_err(conf, "Error opening filename %s: %s", inst->filename, strerror(errno));
-		return -1;
-	}
+	map_proc_register(inst, inst->name, mod_map_proc, csv_map_verify, 0);
 
-	lineno = 1;
-	while (fgets(buffer, sizeof(buffer), fp)) {
-		rlm_csv_entry_t *e;
+	return 0;
+}
 
-		e = file2csv(conf, inst, lineno, buffer);
-		if (!e) {
-			fclose(fp);
-			return -1;
-		}
+/*
+ *	Read the file.  This is done here rather than in
+ *	mod_bootstrap(), as the reload thread has to be started
+ *	after the server has forked.
+ */
+static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
+{
+	rlm_csv_t *inst = instance;
 
-		lineno++;
-	}
+	inst->reload = fr_reload_alloc(inst, inst->name, inst->filename, &inst->reload_interval, csv_load, inst);
+	if (!inst->reload) return -1;
 
-	fclose(fp);
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_csv_t *inst = instance;
 
 	/*
-	 *	And register the map function.
+	 *	Stop the reload thread before we free the field names.
 	 */
-	map_proc_register(inst, inst->name, mod_map_proc, csv_map_verify, 0);
+	TALLOC_FREE(inst->reload);
 
 	return 0;
 }
@@ -476,13 +625,25 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	rlm_csv_t		*inst = talloc_get_type_abort(mod_inst, rlm_csv_t);
 	rlm_csv_entry_t		*e, my_entry;
 	vp_map_t const		*map;
+	void const		*data;
+	rbtree_t		*tree;
 	char			*key_str = NULL;
 
 	if (tmpl_aexpand(request, &key_str, request, key, NULL, NULL) < 0) return RLM_MODULE_FAIL;
 
 	my_entry.key = key_str;
 
-	e = rbtree_finddata(inst->tree, &my_entry);
+	/*
+	 *	The tree (or index) is never changed once it's built,
+	 *	so looking things up in it is safe from any thread.
+	 */
+	data = fr_reload_enter(inst->reload, NULL);
+	if (inst->mmap) {
+		e = csv_mapfile_find(request, inst, data, key_str);
+	} else {
+		memcpy(&tree, &data, sizeof(tree));	/* const */
+		e = rbtree_finddata(tree, &my_entry);
+	}
 	if (!e) {
 		rcode = RLM_MODULE_NOOP;
 		goto finish;
@@ -534,6 +695,8 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	REXDENT();
 
 finish:
+	fr_reload_leave(inst->reload);
+	if (inst->mmap) talloc_free(e);
 	talloc_free(key_str);
 	return rcode;
 }
@@ -546,4 +709,6 @@ rad_module_t rlm_csv = {
 	.inst_size	= sizeof(rlm_csv_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 };
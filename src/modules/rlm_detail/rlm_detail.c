@@ -50,6 +50,14 @@ RCSID("$Id$")
 
 #define DIRLEN	8192		//!< Maximum path length.
 
+#define DETAIL_IDLE_TIMEOUT	30	//!< Free per-thread buffers which haven't been used for this long.
+
+typedef enum {
+	DETAIL_FSYNC_NONE = 0,		//!< Leave it to the kernel.
+	DETAIL_FSYNC_INTERVAL,		//!< At most once every fsync_interval seconds.
+	DETAIL_FSYNC_BATCH		//!< After every write.
+} detail_fsync_t;
+
 /** Instance configuration for rlm_detail
  *
  * Holds the configuration and preparsed data for a instance of rlm_detail.
@@ -67,6 +75,21 @@ typedef struct detail_instance {
 
 	bool		escape;		//!< do filename escaping, yes / no
 
+	char const	*format;	//!< "text" or "binary".
+	bool		binary;		//!< Write binary records.
+
+	bool		lockless;	//!< Append with O_APPEND, without the exfile lock.
+
+	size_t		buffer_size;	//!< Bytes to buffer in each thread before writing.
+	struct timeval	max_delay;	//!< Longest time a record can stay in the buffer.
+
+	char const	*fsync_str;	//!< "none", "interval" or "batch".
+	detail_fsync_t	fsync;		//!< When to call fsync().
+	uint32_t	fsync_interval;	//!< Seconds between calls to fsync() for "interval".
+
+	bool		set_gid;	//!< Whether we change the group of the file.
+	gid_t		gid;		//!< Resolved from "group".
+
 	xlat_escape_t	escape_func; //!< escape function
 
 	exfile_t    	*ef;		//!< Log file handler
@@ -74,6 +97,41 @@ typedef struct detail_instance {
 	fr_hash_table_t *ht;		//!< Holds suppressed attributes.
 } rlm_detail_t;
 
+/** Per-thread state for rlm_detail
+ *
+ */
+typedef struct detail_thread {
+	rlm_detail_t const	*inst;		//!< Instance of rlm_detail.
+	fr_event_list_t		*el;		//!< Event list for this thread.
+	rbtree_t		*files;		//!< Buffers, one per file, ordered by filename.
+	fr_event_timer_t const	*ev;		//!< When we next flush the buffers.
+} rlm_detail_thread_t;
+
+/** Records waiting to be written to one file
+ *
+ */
+typedef struct detail_buffer {
+	rlm_detail_thread_t	*thread;	//!< Thread which owns the buffer.
+	char const		*filename;	//!< File the records are written to.
+
+	uint8_t			*data;		//!< Whole records.
+	size_t			used;		//!< How much of "data" holds records.
+	size_t			size;		//!< How much was allocated.
+	uint32_t		records;	//!< How many records are in "data".
+
+	int			fd;		//!< Our own descriptor, for "lockless".
+	time_t			opened;		//!< When "fd" was opened.
+
+	time_t			last_sync;	//!< When we last called fsync().
+	time_t			last_used;	//!< When we last added a record.
+} detail_buffer_t;
+
+static const CONF_PARSER buffer_config[] = {
+	{ FR_CONF_OFFSET("size", FR_TYPE_SIZE, rlm_detail_t, buffer_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_delay", FR_TYPE_TIMEVAL, rlm_detail_t, max_delay), .dflt = "1" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_REQUIRED | FR_TYPE_XLAT, rlm_detail_t, filename), .dflt = "%A/%{Client-IP-Address}/detail" },
 	{ FR_CONF_OFFSET("header", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_detail_t, header), .dflt = "%t" },
@@ -82,6 +140,11 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("locking", FR_TYPE_BOOL, rlm_detail_t, locking), .dflt = "no" },
 	{ FR_CONF_OFFSET("escape_filenames", FR_TYPE_BOOL, rlm_detail_t, escape), .dflt = "no" },
 	{ FR_CONF_OFFSET("log_packet_header", FR_TYPE_BOOL, rlm_detail_t, log_srcdst), .dflt = "no" },
+	{ FR_CONF_OFFSET("format", FR_TYPE_STRING, rlm_detail_t, format), .dflt = "text" },
+	{ FR_CONF_OFFSET("lockless", FR_TYPE_BOOL, rlm_detail_t, lockless), .dflt = "no" },
+	{ FR_CONF_OFFSET("fsync", FR_TYPE_STRING, rlm_detail_t, fsync_str), .dflt = "none" },
+	{ FR_CONF_OFFSET("fsync_interval", FR_TYPE_UINT32, rlm_detail_t, fsync_interval), .dflt = "1" },
+	{ FR_CONF_POINTER("buffer", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) buffer_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -129,6 +192,55 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		inst->escape_func = rad_filename_make_safe;
 	}
 
+	if (strcmp(inst->format, "binary") == 0) {
+		inst->binary = true;
+	} else if (strcmp(inst->format, "text") != 0) {
+		cf_log_err(conf, "Invalid value '%s' for 'format'.  Must be 'text' or 'binary'", inst->format);
+		return -1;
+	}
+
+	if (strcmp(inst->fsync_str, "batch") == 0) {
+		inst->fsync = DETAIL_FSYNC_BATCH;
+	} else if (strcmp(inst->fsync_str, "interval") == 0) {
+		inst->fsync = DETAIL_FSYNC_INTERVAL;
+	} else if (strcmp(inst->fsync_str, "none") == 0) {
+		inst->fsync = DETAIL_FSYNC_NONE;
+	} else {
+		cf_log_err(conf, "Invalid value '%s' for 'fsync'.  Must be 'none', 'interval' or 'batch'",
+			   inst->fsync_str);
+		return -1;
+	}
+
+	FR_INTEGER_BOUND_CHECK("fsync_interval", inst->fsync_interval, >=, 1);
+	FR_INTEGER_BOUND_CHECK("fsync_interval", inst->fsync_interval, <=, 3600);
+
+	FR_TIMEVAL_BOUND_CHECK("buffer.max_delay", &inst->max_delay, >=, 0, 1000);
+	FR_TIMEVAL_BOUND_CHECK("buffer.max_delay", &inst->max_delay, <=, 60, 0);
+
+	/*
+	 *	Other processes (e.g. the detail reader) can only
+	 *	lock the file if everyone writing to it does.
+	 */
+	if (inst->lockless && inst->locking) {
+		cf_log_err(conf, "'lockless' cannot be used with 'locking'");
+		return -1;
+	}
+
+	if (inst->group) {
+		char *endptr;
+
+		inst->gid = strtol(inst->group, &endptr, 10);
+		if (*endptr != '\0') {
+			if (rad_getgid(inst, &inst->gid, inst->group) < 0) {
+				WARN("Unable to find system group '%s'", inst->group);
+			} else {
+				inst->set_gid = true;
+			}
+		} else {
+			inst->set_gid = true;
+		}
+	}
+
 	inst->ef = module_exfile_init(inst, conf, 256, 30, inst->locking, NULL, NULL);
 	if (!inst->ef) {
 		cf_log_err(conf, "Failed creating log file context");
@@ -190,24 +302,97 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+/** Make room for at least "need" more bytes in a buffer
+ *
+ */
+static int detail_buffer_grow(detail_buffer_t *out, size_t need)
+{
+	uint8_t	*data;
+	size_t	size;
+
+	if ((out->size - out->used) >= need) return 0;
+
+	size = out->size * 2;
+	if (size < (out->used + need)) size = out->used + need;
+
+	data = talloc_realloc(out, out->data, uint8_t, size);
+	if (!data) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	out->data = data;
+	out->size = size;
+
+	return 0;
+}
+
+/** Append formatted text to a buffer
+ *
+ */
+static int CC_HINT(format (printf, 2, 3)) detail_printf(detail_buffer_t *out, char const *fmt, ...)
+{
+	va_list	ap;
+	int	len;
+
+	va_start(ap, fmt);
+	len = vsnprintf((char *) out->data + out->used, out->size - out->used, fmt, ap);
+	va_end(ap);
+	if (len < 0) return -1;
+
+	if ((size_t) len >= (out->size - out->used)) {
+		if (detail_buffer_grow(out, len + 1) < 0) return -1;
+
+		va_start(ap, fmt);
+		vsnprintf((char *) out->data + out->used, out->size - out->used, fmt, ap);
+		va_end(ap);
+	}
+
+	out->used += len;
+
+	return 0;
+}
+
+/** Append an attribute to a buffer, in the same format as fr_pair_fprint()
+ *
+ */
+static int detail_pair_print(detail_buffer_t *out, VALUE_PAIR const *vp)
+{
+	char	buffer[1024];
+	size_t	len;
+
+	len = fr_pair_snprint(buffer, sizeof(buffer), vp);
+	if (!len) return 0;
+
+	/*
+	 *	Deal with truncation gracefully
+	 */
+	if (len >= sizeof(buffer)) len = sizeof(buffer) - 1;
+
+	return detail_printf(out, "\t%.*s\n", (int) len, buffer);
+}
+
 /*
  *	Wrapper for VPs allocated on the stack.
  */
-static void detail_fr_pair_fprint(TALLOC_CTX *ctx, FILE *out, VALUE_PAIR const *stacked)
+static int detail_pair_print_stacked(TALLOC_CTX *ctx, detail_buffer_t *out, VALUE_PAIR const *stacked)
 {
-	VALUE_PAIR *vp;
+	VALUE_PAIR	*vp;
+	int		ret;
 
 	vp = talloc(ctx, VALUE_PAIR);
-	if (!vp) return;
+	if (!vp) return -1;
 
 	memcpy(vp, stacked, sizeof(*vp));
 	vp->op = T_OP_EQ;
-	fr_pair_fprint(out, vp);
+	ret = detail_pair_print(out, vp);
 	talloc_free(vp);
+
+	return ret;
 }
 
 
-/** Write a single detail entry to file pointer
+/** Write a single detail entry to a buffer
  *
  * @param[in] out Where to write entry.
  * @param[in] inst Instance of rlm_detail.
@@ -215,7 +400,7 @@ static void detail_fr_pair_fprint(TALLOC_CTX *ctx, FILE *out, VALUE_PAIR const *
  * @param[in] packet associated with the request (request, reply, proxy-request, proxy-reply...).
  * @param[in] compat Write out entry in compatibility mode.
  */
-static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, RADIUS_PACKET *packet, bool compat)
+static int detail_write(detail_buffer_t *out, rlm_detail_t const *inst, REQUEST *request, RADIUS_PACKET *packet, bool compat)
 {
 	VALUE_PAIR *vp;
 	char timestamp[256];
@@ -230,8 +415,8 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 	}
 
 #define WRITE(fmt, ...) do {\
-	if (fprintf(out, fmt, ## __VA_ARGS__) < 0) {\
-		RERROR("Failed writing to detail file: %s", fr_syserror(errno));\
+	if (detail_printf(out, fmt, ## __VA_ARGS__) < 0) {\
+		RERROR("Failed writing detail record: %s", fr_strerror());\
 		return -1;\
 	}\
 } while(0)
@@ -281,16 +466,30 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 			break;
 		}
 
-		detail_fr_pair_fprint(request, out, &src_vp);
-		detail_fr_pair_fprint(request, out, &dst_vp);
+		if ((detail_pair_print_stacked(request, out, &src_vp) < 0) ||
+		    (detail_pair_print_stacked(request, out, &dst_vp) < 0)) {
+			RERROR("Failed writing detail record: %s", fr_strerror());
+			return -1;
+		}
 
 		src_vp.da = fr_dict_attr_by_num(NULL, 0, FR_PACKET_SRC_PORT);
 		src_vp.vp_uint32 = packet->src_port;
 		dst_vp.da = fr_dict_attr_by_num(NULL, 0, FR_PACKET_DST_PORT);
 		dst_vp.vp_uint32 = packet->dst_port;
 
-		detail_fr_pair_fprint(request, out, &src_vp);
-		detail_fr_pair_fprint(request, out, &dst_vp);
+		if ((detail_pair_print_stacked(request, out, &src_vp) < 0) ||
+		    (detail_pair_print_stacked(request, out, &dst_vp) < 0)) {
+			RERROR("Failed writing detail record: %s", fr_strerror());
+			return -1;
+		}
+	}
+
+	/*
+	 *	Everything gets written out, so decode any VSAs which
+	 *	were left for later.
+	 */
+	if (packet->lazy && (fr_radius_packet_decode_pending(packet, NULL) < 0)) {
+		RWDEBUG("Failed decoding attributes: %s", fr_strerror());
 	}
 
 	{
@@ -313,7 +512,11 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 			 */
 			op = vp->op;
 			vp->op = T_OP_EQ;
-			fr_pair_fprint(out, vp);
+			if (detail_pair_print(out, vp) < 0) {
+				vp->op = op;
+				RERROR("Failed writing detail record: %s", fr_strerror());
+				return -1;
+			}
 			vp->op = op;
 		}
 	}
@@ -339,23 +542,343 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 	return 0;
 }
 
+/** Whether an attribute is left out of a binary record
+ *
+ */
+static bool detail_binary_filter(VALUE_PAIR const *vp, void *uctx)
+{
+	rlm_detail_t const	*inst = uctx;
+
+	return inst->ht && fr_hash_table_finddata(inst->ht, vp->da);
+}
+
+static bool detail_binary_filter_compat(VALUE_PAIR const *vp, void *uctx)
+{
+	/*
+	 *	Don't write passwords in old format...
+	 */
+	if (!vp->da->vendor && (vp->da->attr == FR_USER_PASSWORD)) return true;
+
+	return detail_binary_filter(vp, uctx);
+}
+
+/** Write a single binary detail entry to a buffer
+ *
+ * The header line, and the packet source and destination, are in the
+ * fixed part of the record.
+ *
+ * @param[in] out Where to write entry.
+ * @param[in] inst Instance of rlm_detail.
+ * @param[in] request The current request.
+ * @param[in] packet associated with the request (request, reply, proxy-request, proxy-reply...).
+ * @param[in] compat Write out entry in compatibility mode.
+ */
+static int detail_write_binary(detail_buffer_t *out, rlm_detail_t const *inst, REQUEST *request, RADIUS_PACKET *packet,
+			       bool compat)
+{
+	fr_detail_record_t	rec;
+	uint8_t			*record;
+	ssize_t			len;
+	void			*uctx;
+
+	if (!packet->vps) {
+		RWDEBUG("Skipping empty packet");
+		return 0;
+	}
+
+	if (packet->lazy && (fr_radius_packet_decode_pending(packet, NULL) < 0)) {
+		RWDEBUG("Failed decoding attributes: %s", fr_strerror());
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.code = packet->code;
+	rec.timestamp = request->packet->timestamp;
+	rec.src_ipaddr = packet->src_ipaddr;
+	rec.dst_ipaddr = packet->dst_ipaddr;
+	rec.src_port = packet->src_port;
+	rec.dst_port = packet->dst_port;
+
+	memcpy(&uctx, &inst, sizeof(uctx)); /* const issues */
+
+	len = fr_detail_binary_encode(request, &record, &rec, packet->vps,
+				      compat ? detail_binary_filter_compat : detail_binary_filter, uctx);
+	if (len < 0) {
+		RPERROR("Failed encoding detail record");
+		return -1;
+	}
+
+	if (detail_buffer_grow(out, len) < 0) {
+		RERROR("Failed writing detail record: %s", fr_strerror());
+		talloc_free(record);
+		return -1;
+	}
+
+	memcpy(out->data + out->used, record, len);
+	out->used += len;
+
+	talloc_free(record);
+
+	return 0;
+}
+
+static int _detail_buffer_free(detail_buffer_t *buf)
+{
+	if (buf->fd >= 0) close(buf->fd);
+
+	return 0;
+}
+
+static int detail_buffer_cmp(void const *one, void const *two)
+{
+	detail_buffer_t const *a = one, *b = two;
+
+	return strcmp(a->filename, b->filename);
+}
+
+/** Find or create this thread's buffer for a file
+ *
+ */
+static detail_buffer_t *detail_buffer_find(rlm_detail_thread_t *t, char const *filename)
+{
+	detail_buffer_t		find, *buf;
+
+	find.filename = filename;
+	buf = rbtree_finddata(t->files, &find);
+	if (buf) return buf;
+
+	buf = talloc_zero(t->files, detail_buffer_t);
+	if (!buf) return NULL;
+
+	buf->thread = t;
+	buf->fd = -1;
+	buf->filename = talloc_strdup(buf, filename);
+	buf->size = 4096;
+	buf->data = talloc_array(buf, uint8_t, buf->size);
+	if (!buf->filename || !buf->data) {
+		talloc_free(buf);
+		return NULL;
+	}
+	talloc_set_destructor(buf, _detail_buffer_free);
+
+	if (!rbtree_insert(t->files, buf)) {
+		talloc_free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/** Open a file for "lockless", where we append with O_APPEND
+ *
+ * The kernel appends each write() as a whole, so threads don't have to
+ * lock the file against each other.  Each thread has its own
+ * descriptor, which is re-opened every second so that we notice when
+ * the file has been moved away.
+ */
+static int detail_open_lockless(detail_buffer_t *buf, time_t now)
+{
+	rlm_detail_t const	*inst = buf->thread->inst;
+	char			*dir, *p;
+	mode_t			dirperm;
+
+	if ((buf->fd >= 0) && (buf->opened == now)) return buf->fd;
+
+	if (buf->fd >= 0) close(buf->fd);
+
+	buf->fd = open(buf->filename, O_WRONLY | O_APPEND | O_CREAT, inst->perm);
+	if (buf->fd >= 0) goto done;
+
+	if (errno != ENOENT) {
+	error:
+		fr_strerror_printf("Failed to open file %s: %s", buf->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	/*
+	 *	Maybe the directory doesn't exist.  Try to create it.
+	 */
+	dir = talloc_strdup(buf, buf->filename);
+	if (!dir) return -1;
+
+	p = strrchr(dir, FR_DIR_SEP);
+	if (!p) {
+		fr_strerror_printf("No '/' in '%s'", buf->filename);
+		talloc_free(dir);
+		return -1;
+	}
+	*p = '\0';
+
+	/*
+	 *	Ensure that the 'x' bit is set, so that we can
+	 *	read the directory.
+	 */
+	dirperm = inst->perm;
+	if ((dirperm & 0600) != 0) dirperm |= 0100;
+	if ((dirperm & 0060) != 0) dirperm |= 0010;
+	if ((dirperm & 0006) != 0) dirperm |= 0001;
+
+	if (rad_mkdir(dir, dirperm, -1, -1) < 0) {
+		fr_strerror_printf("Failed to create directory %s: %s", dir, fr_syserror(errno));
+		talloc_free(dir);
+		return -1;
+	}
+	talloc_free(dir);
+
+	buf->fd = open(buf->filename, O_WRONLY | O_APPEND | O_CREAT, inst->perm);
+	if (buf->fd < 0) goto error;
+
+done:
+	buf->opened = now;
+
+	return buf->fd;
+}
+
+/** Write all of the records in a buffer to its file
+ *
+ * The file is opened and locked once for the whole batch, which is
+ * written with one write(), and then synced if the "fsync" policy says
+ * so.  If the write fails, the records are discarded.
+ *
+ * @param[in] buf to write.
+ * @param[in] request The current request.  May be NULL.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int detail_flush(detail_buffer_t *buf, REQUEST *request)
+{
+	rlm_detail_t const	*inst = buf->thread->inst;
+	uint8_t const		*p = buf->data, *end = buf->data + buf->used;
+	int			fd, ret = 0;
+	time_t			now;
+
+	if (!buf->used) return 0;
+
+	now = time(NULL);
+
+	if (inst->lockless) {
+		fd = detail_open_lockless(buf, now);
+	} else {
+		fd = exfile_open(inst->ef, request, buf->filename, inst->perm, true);
+	}
+	if (fd < 0) {
+		ROPTIONAL(RERROR, ERROR, "Couldn't open file %s: %s", buf->filename, fr_strerror());
+		ret = -1;
+		goto done;
+	}
+
+	if (inst->set_gid && (chown(buf->filename, -1, inst->gid) == -1)) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "Unable to change system group of '%s'", buf->filename);
+	}
+
+	while (p < end) {
+		ssize_t slen;
+
+		slen = write(fd, p, end - p);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+
+			ROPTIONAL(RERROR, ERROR, "Failed writing to detail file %s: %s",
+				  buf->filename, fr_syserror(errno));
+			ret = -1;
+			break;
+		}
+		p += slen;
+	}
+
+	if ((ret == 0) &&
+	    ((inst->fsync == DETAIL_FSYNC_BATCH) ||
+	     ((inst->fsync == DETAIL_FSYNC_INTERVAL) && (now >= (buf->last_sync + (time_t) inst->fsync_interval))))) {
+		if (fsync(fd) < 0) {
+			ROPTIONAL(RWARN, WARN, "Failed syncing detail file %s: %s",
+				  buf->filename, fr_syserror(errno));
+		}
+		buf->last_sync = now;
+	}
+
+	if (!inst->lockless) {
+		close(fd);
+		exfile_unlock(inst->ef, request, fd);
+	}
+
+done:
+	if ((ret < 0) && (buf->records > 1)) {
+		ROPTIONAL(RERROR, ERROR, "Discarding %u records for %s", buf->records, buf->filename);
+	}
+
+	buf->used = 0;
+	buf->records = 0;
+
+	return ret;
+}
+
+static int detail_buffer_flush_walk(UNUSED void *ctx, void *data)
+{
+	detail_buffer_t *buf = talloc_get_type_abort(data, detail_buffer_t);
+
+	(void) detail_flush(buf, NULL);
+
+	return 0;
+}
+
+/** Flush a buffer, and free it if it hasn't been used for a while
+ *
+ */
+static int detail_buffer_expire(void *ctx, void *data)
+{
+	time_t		*now = ctx;
+	detail_buffer_t	*buf = talloc_get_type_abort(data, detail_buffer_t);
+
+	(void) detail_flush(buf, NULL);
+
+	if ((buf->last_used + DETAIL_IDLE_TIMEOUT) < *now) return 2;	/* delete, and continue */
+
+	return 0;
+}
+
+static void detail_timer(fr_event_list_t *el, struct timeval *now, void *uctx);
+
+static void detail_timer_arm(rlm_detail_thread_t *t)
+{
+	rlm_detail_t const	*inst = t->inst;
+	struct timeval		when;
+
+	if (t->ev) return;
+
+	gettimeofday(&when, NULL);
+	fr_timeval_add(&when, &when, &inst->max_delay);
+
+	if (fr_event_timer_insert(t, t->el, &t->ev, &when, detail_timer, t) < 0) {
+		ERROR("Failed inserting flush timer: %s", fr_strerror());
+	}
+}
+
+/** Write out the records which have been buffered for too long
+ *
+ */
+static void detail_timer(UNUSED fr_event_list_t *el, struct timeval *now, void *uctx)
+{
+	rlm_detail_thread_t	*t = talloc_get_type_abort(uctx, rlm_detail_thread_t);
+	time_t			when = now->tv_sec;
+
+	rbtree_walk(t->files, RBTREE_DELETE_ORDER, detail_buffer_expire, &when);
+
+	if (rbtree_num_elements(t->files) > 0) detail_timer_arm(t);
+}
+
 /*
  *	Do detail, compatible with old accounting
  */
-static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, REQUEST *request,
+static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, void *thread, REQUEST *request,
 					      RADIUS_PACKET *packet, bool compat)
 {
-	int		outfd;
-	char		buffer[DIRLEN];
-
-	FILE		*outfp;
-
-#ifdef HAVE_GRP_H
-	gid_t		gid;
-	char		*endptr;
-#endif
+	char			buffer[DIRLEN];
+	detail_buffer_t		*buf;
+	size_t			start;
+	int			ret;
 
-	rlm_detail_t const *inst = instance;
+	rlm_detail_t const	*inst = instance;
+	rlm_detail_thread_t	*t = talloc_get_type_abort(thread, rlm_detail_thread_t);
 
 	/*
 	 *	Generate the path for the detail file.  Use the same
@@ -385,46 +908,34 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, REQUEST *req
 #endif
 #endif
 
-	outfd = exfile_open(inst->ef, request, buffer, inst->perm, true);
-	if (outfd < 0) {
-		RERROR("Couldn't open file %s: %s", buffer, fr_strerror());
-		/* coverity[missing_unlock] */
+	buf = detail_buffer_find(t, buffer);
+	if (!buf) {
+		RERROR("Failed allocating buffer for %s", buffer);
 		return RLM_MODULE_FAIL;
 	}
 
-	if (inst->group != NULL) {
-		gid = strtol(inst->group, &endptr, 10);
-		if (*endptr != '\0') {
-			if (rad_getgid(request, &gid, inst->group) < 0) {
-				RDEBUG2("Unable to find system group '%s'", inst->group);
-				goto skip_group;
-			}
-		}
+	start = buf->used;
 
-		if (chown(buffer, -1, gid) == -1) {
-			RDEBUG2("Unable to change system group of '%s'", buffer);
-		}
+	if (inst->binary) {
+		ret = detail_write_binary(buf, inst, request, packet, compat);
+	} else {
+		ret = detail_write(buf, inst, request, packet, compat);
 	}
-
-skip_group:
-	/*
-	 *	Open the output fp for buffering.
-	 */
-	if ((outfp = fdopen(outfd, "a")) == NULL) {
-		RERROR("Couldn't open file %s: %s", buffer, fr_syserror(errno));
-	fail:
-		if (outfp) fclose(outfp);
-		exfile_unlock(inst->ef, request, outfd);
+	if (ret < 0) {
+		buf->used = start;
 		return RLM_MODULE_FAIL;
 	}
 
-	if (detail_write(outfp, inst, request, packet, compat) < 0) goto fail;
+	if (buf->used > start) buf->records++;
+	buf->last_used = time(NULL);
+
+	detail_timer_arm(t);
 
 	/*
-	 *	Flush everything
+	 *	Unless we're buffering, the record is on its way to
+	 *	disk before we return.
 	 */
-	fclose(outfp);
-	exfile_unlock(inst->ef, request, outfd); /* do NOT close outfp */
+	if ((buf->used >= inst->buffer_size) && (detail_flush(buf, request) < 0)) return RLM_MODULE_FAIL;
 
 	/*
 	 *	And everything is fine.
@@ -435,7 +946,7 @@ skip_group:
 /*
  *	Accounting - write the detail files.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, void *thread, REQUEST *request)
 {
 #ifdef WITH_DETAIL
 	if (request->listener && (request->listener->type == RAD_LISTEN_DETAIL) &&
@@ -446,40 +957,40 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 	}
 #endif
 
-	return detail_do(instance, request, request->packet, true);
+	return detail_do(instance, thread, request, request->packet, true);
 }
 
 /*
  *	Incoming Access Request - write the detail files.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->packet, false);
+	return detail_do(instance, thread, request, request->packet, false);
 }
 
 /*
  *	Outgoing Access-Request Reply - write the detail files.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->reply, false);
+	return detail_do(instance, thread, request, request->reply, false);
 }
 
 #ifdef WITH_COA
 /*
  *	Incoming CoA - write the detail files.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_recv_coa(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_recv_coa(void *instance, void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->packet, false);
+	return detail_do(instance, thread, request, request->packet, false);
 }
 
 /*
  *	Outgoing CoA - write the detail files.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_send_coa(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_send_coa(void *instance, void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->reply, false);
+	return detail_do(instance, thread, request, request->reply, false);
 }
 #endif
 
@@ -487,9 +998,9 @@ static rlm_rcode_t CC_HINT(nonnull) mod_send_coa(void *instance, UNUSED void *th
  *	Outgoing Access-Request to home server - write the detail files.
  */
 #ifdef WITH_PROXY
-static rlm_rcode_t CC_HINT(nonnull) mod_pre_proxy(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_pre_proxy(void *instance, void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->proxy->packet, false);
+	return detail_do(instance, thread, request, request->proxy->packet, false);
 }
 
 
@@ -515,10 +1026,41 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_proxy(void *instance, void *thread,
 		return rcode;
 	}
 
-	return detail_do(instance, request, request->proxy->reply, false);
+	return detail_do(instance, thread, request, request->proxy->reply, false);
 }
 #endif
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el,
+				  void *thread)
+{
+	rlm_detail_thread_t *t = talloc_get_type_abort(thread, rlm_detail_thread_t);
+
+	t->inst = instance;
+	t->el = el;
+
+	t->files = rbtree_create(t, detail_buffer_cmp, rbtree_node_talloc_free, 0);
+	if (!t->files) return -1;
+
+	return 0;
+}
+
+/** Write out anything which is still buffered
+ *
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_detail_thread_t *t = talloc_get_type_abort(thread, rlm_detail_thread_t);
+
+	if (t->ev) fr_event_timer_delete(t->el, &t->ev);
+
+	if (t->files) {
+		rbtree_walk(t->files, RBTREE_IN_ORDER, detail_buffer_flush_walk, NULL);
+		TALLOC_FREE(t->files);
+	}
+
+	return 0;
+}
+
 /* globally exported name */
 extern rad_module_t rlm_detail;
 rad_module_t rlm_detail = {
@@ -526,8 +1068,11 @@ rad_module_t rlm_detail = {
 	.name		= "detail",
 	.inst_size	= sizeof(rlm_detail_t),
 	.config		= module_config,
+	.thread_inst_size = sizeof(rlm_detail_thread_t),
 	.instantiate	= mod_instantiate,
+	.thread_instantiate = mod_thread_instantiate,
 	.detach		= mod_detach,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 		[MOD_PREACCT]		= mod_accounting,
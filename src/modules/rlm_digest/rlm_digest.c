@@ -584,6 +584,7 @@ extern rad_module_t rlm_digest;
 rad_module_t rlm_digest = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "digest",
+	.type		= RLM_TYPE_SHADOW_SAFE,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
@@ -764,6 +764,8 @@ eap_session_t *eap_session_thaw(REQUEST *request)
 	eap_session->request = request;
 	eap_session->updated = request->packet->timestamp.tv_sec;
 
+	eap_session_memory_release(eap_session);
+
 	return eap_session;
 }
 
@@ -858,6 +860,8 @@ eap_session_t *eap_session_continue(eap_packet_raw_t **eap_packet_p, rlm_eap_t c
 	 *	Packet was EAP identity, allocate a new eap_session.
 	 */
 	} else {
+		if (!eap_session_memory_available(inst, request)) goto error_round;
+
 		eap_session = eap_session_alloc(inst, request);
 		if (!eap_session) goto error_round;
 
@@ -60,6 +60,8 @@ struct _eap_session {
 	eap_session_t	*prev, *next;			//!< Next/previous eap session in this doubly linked list.
 
 	eap_session_t	*child;				//!< Session for tunneled EAP method.
+	REQUEST		*subrequest;			//!< Tunneled request which yielded, and will be
+							///< continued when this request is resumed.
 
 	void const	*inst;				//!< Instance of the eap module this session was created by.
 	eap_type_t	type;				//!< EAP method number.
@@ -83,6 +85,8 @@ struct _eap_session {
 
 	time_t		updated;			//!< The last time we received a packet for this EAP session.
 
+	size_t		memory;				//!< Bytes accounted to the module instance whilst frozen.
+
 	bool		tls;				//!< Whether EAP method uses TLS.
 	bool		finished;			//!< Whether we consider this session complete.
 };
@@ -120,5 +124,8 @@ typedef struct eap_tunnel_data_t {
 
 rlm_rcode_t	eap_virtual_server(REQUEST *request, REQUEST *fake,
 				   eap_session_t *eap_session, char const *virtual_server);
+rlm_rcode_t	eap_virtual_server_child(REQUEST *request, REQUEST *fake,
+					 eap_session_t *eap_session, char const *virtual_server);
+rlm_rcode_t	eap_virtual_server_resume(REQUEST *request, eap_session_t *eap_session, REQUEST **fake);
 
 #endif /*_EAP_H*/
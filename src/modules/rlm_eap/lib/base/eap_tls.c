@@ -78,6 +78,7 @@ FR_NAME_NUMBER const eap_tls_status_table[] = {
 	{ "established",		EAP_TLS_ESTABLISHED },
 	{ "fail",			EAP_TLS_FAIL },
 	{ "handled",			EAP_TLS_HANDLED },
+	{ "yield",			EAP_TLS_YIELD },
 
 	{ "start",			EAP_TLS_START_SEND },
 	{ "request",			EAP_TLS_RECORD_SEND },
@@ -183,6 +184,12 @@ int eap_tls_compose(eap_session_t *eap_session, eap_tls_status_t status, uint8_t
 
 	if (record) tls_session->record_to_buff(record, p, frag_len);
 
+	/*
+	 *	The session is idle until the peer responds,
+	 *	so release the buffers it doesn't need.
+	 */
+	tls_session_compact(tls_session);
+
 	switch (status) {
 	case EAP_TLS_ACK_SEND:
 	case EAP_TLS_START_SEND:
@@ -777,12 +784,36 @@ ignore_length:
 	return EAP_TLS_RECORD_RECV_COMPLETE;
 }
 
+/** Stop waiting on the fds of a private key operation
+ *
+ */
+static void eap_tls_async_fd_delete(REQUEST *request, eap_tls_session_t *eap_tls_session, unsigned int count)
+{
+	tls_session_t	*tls_session = eap_tls_session->tls_session;
+	unsigned int	i;
+
+	for (i = 0; i < count; i++) unlang_event_fd_delete(request, eap_tls_session, tls_session->async_fd[i]);
+}
+
+/** Resume the request when the engine or crypto thread has finished with the private key
+ *
+ */
+static void eap_tls_async_read(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+			       UNUSED int fd)
+{
+	eap_tls_session_t *eap_tls_session = talloc_get_type_abort(ctx, eap_tls_session_t);
+
+	eap_tls_async_fd_delete(request, eap_tls_session, eap_tls_session->tls_session->async_fd_count);
+	unlang_resumable(request);
+}
+
 /** Continue with the handshake
  *
  * @param eap_session to continue.
  * @return
  *	- EAP_TLS_FAIL if the message is invalid.
  *	- EAP_TLS_HANDLED if we need to send an additional request to the peer.
+ *	- EAP_TLS_YIELD if a crypto thread is performing a private key operation.
  *	- EAP_TLS_ESTABLISHED if the handshake completed successfully, and there's
  *	  no more data to send.
  */
@@ -795,10 +826,34 @@ static eap_tls_status_t eap_tls_handshake(eap_session_t *eap_session)
 	/*
 	 *	Continue the TLS handshake
 	 */
-	if (!tls_session_handshake(eap_session->request, tls_session)) {
+	switch (tls_session_handshake(eap_session->request, tls_session)) {
+	case 0:
 		REDEBUG("TLS receive handshake failed during operation");
 		tls_cache_deny(tls_session);
 		return EAP_TLS_FAIL;
+
+	/*
+	 *	Wait for the engine or crypto thread, then
+	 *	call tls_session_handshake() again.
+	 */
+	case 2:
+	{
+		unsigned int i;
+
+		for (i = 0; i < tls_session->async_fd_count; i++) {
+			if (unlang_event_fd_add(request, eap_tls_async_read, NULL, NULL,
+						eap_tls_session, tls_session->async_fd[i]) < 0) {
+				REDEBUG("Failed waiting for private key operation");
+				eap_tls_async_fd_delete(request, eap_tls_session, i);
+				tls_session->invalid = true;
+				return EAP_TLS_FAIL;
+			}
+		}
+	}
+		return EAP_TLS_YIELD;
+
+	default:
+		break;
 	}
 
 	/*
@@ -878,6 +933,16 @@ eap_tls_status_t eap_tls_process(eap_session_t *eap_session)
 
 	SSL_set_ex_data(tls_session->ssl, FR_TLS_EX_INDEX_REQUEST, request);
 
+	/*
+	 *	We're being resumed after a crypto thread completed
+	 *	a private key operation.  The record from the peer
+	 *	has already been given to OpenSSL.
+	 */
+	if (tls_session->async_pending) {
+		status = eap_tls_handshake(eap_session);
+		goto done;
+	}
+
 	/*
 	 *	Call eap_tls_verify to sanity check the incoming EAP data.
 	 */
@@ -1074,6 +1139,13 @@ eap_tls_session_t *eap_tls_session_init(eap_session_t *eap_session, fr_tls_conf_
 	SSL_set_ex_data(tls_session->ssl, FR_TLS_EX_INDEX_STORE, (void *)tls_conf->ocsp.store);
 #endif
 
+	/*
+	 *	Let the crypto threads perform private key operations.
+	 *	Tunnelled sessions are processed synchronously by the
+	 *	outer session, so they can't yield.
+	 */
+	if (!request->parent) tls_async_session_enable(tls_session);
+
 	return eap_tls_session;
 }
 
@@ -92,6 +92,8 @@ typedef enum {
 	EAP_TLS_ESTABLISHED,       			//!< Session established, send success (or start phase2).
 	EAP_TLS_FAIL,       				//!< Fail, send fail.
 	EAP_TLS_HANDLED,	  			//!< TLS code has handled it.
+	EAP_TLS_YIELD,					//!< Waiting for a crypto thread, call again when
+							//!< the request is resumed.
 
 	/*
 	 *	Composition states, we need to
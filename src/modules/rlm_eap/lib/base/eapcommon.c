@@ -392,26 +392,12 @@ void eap_add_reply(REQUEST *request,
 	REXDENT();
 }
 
-/** Send a fake request to a virtual server, managing the eap_session_t of the child
- *
- * If eap_session_t has a child, inject that into the fake request.
- *
- * If after the request has run, the child eap_session_t is no longer present,
- * we assume it has been freed, and fixup the parent eap_session_t.
+/** Prepare a fake request for a virtual server, injecting the eap_session_t of the child
  *
- * If the eap_session_t pointer changes, this is considered a fatal error.
- *
- * @param request the current (real) request.
- * @param eap_session representing the outer eap method.
- * @param fake request we're going to send.
- * @param virtual_server The default virtual server to send the request to.
- * @return the rcode of the last executed section in the virtual server.
  */
-rlm_rcode_t eap_virtual_server(REQUEST *request, REQUEST *fake,
-			       eap_session_t *eap_session, char const *virtual_server)
+static void eap_virtual_server_init(REQUEST *request, REQUEST *fake,
+				    eap_session_t *eap_session, char const *virtual_server)
 {
-	eap_session_t	*eap_session_inner;
-	rlm_rcode_t	rcode;
 	VALUE_PAIR	*vp;
 
 	vp = fr_pair_find_by_num(request->control, 0, FR_VIRTUAL_SERVER, TAG_ANY);
@@ -432,8 +418,14 @@ rlm_rcode_t eap_virtual_server(REQUEST *request, REQUEST *fake,
 		RDEBUG4("Adding eap_session_t %p to fake request", eap_session->child);
 		request_data_add(fake, NULL, REQUEST_DATA_EAP_SESSION, eap_session->child, false, false, false);
 	}
+}
 
-	rcode = rad_virtual_server(fake);
+/** Fixup the eap_session_t of the child, after the fake request has run
+ *
+ */
+static void eap_virtual_server_done(REQUEST *request, REQUEST *fake, eap_session_t *eap_session)
+{
+	eap_session_t	*eap_session_inner;
 
 	eap_session_inner = request_data_get(fake, NULL, REQUEST_DATA_EAP_SESSION);
 	if (eap_session_inner) {
@@ -461,6 +453,97 @@ rlm_rcode_t eap_virtual_server(REQUEST *request, REQUEST *fake,
 		RDEBUG4("Inner server freed eap_session %p", eap_session->child);
 		eap_session->child = NULL;
 	}
+}
+
+/** Send a fake request to a virtual server, managing the eap_session_t of the child
+ *
+ * If eap_session_t has a child, inject that into the fake request.
+ *
+ * If after the request has run, the child eap_session_t is no longer present,
+ * we assume it has been freed, and fixup the parent eap_session_t.
+ *
+ * If the eap_session_t pointer changes, this is considered a fatal error.
+ *
+ * @param request the current (real) request.
+ * @param eap_session representing the outer eap method.
+ * @param fake request we're going to send.
+ * @param virtual_server The default virtual server to send the request to.
+ * @return the rcode of the last executed section in the virtual server.
+ */
+rlm_rcode_t eap_virtual_server(REQUEST *request, REQUEST *fake,
+			       eap_session_t *eap_session, char const *virtual_server)
+{
+	rlm_rcode_t	rcode;
+
+	eap_virtual_server_init(request, fake, eap_session, virtual_server);
+
+	rcode = rad_virtual_server(fake);
+
+	eap_virtual_server_done(request, fake, eap_session);
+
+	return rcode;
+}
+
+/** Send a fake request to a virtual server, allowing the modules it calls to yield
+ *
+ * As #eap_virtual_server, but if the fake request yields, it's recorded in
+ * the eap_session_t, and RLM_MODULE_YIELD is returned.  The EAP method should
+ * then return RLM_MODULE_YIELD, and call #eap_virtual_server_resume when
+ * it's called again.
+ *
+ * @param request the current (real) request.
+ * @param eap_session representing the outer eap method.
+ * @param fake request we're going to send.
+ * @param virtual_server The default virtual server to send the request to.
+ * @return
+ *	- RLM_MODULE_YIELD if the fake request is waiting for an event.
+ *	- the rcode of the last executed section in the virtual server.
+ */
+rlm_rcode_t eap_virtual_server_child(REQUEST *request, REQUEST *fake,
+				     eap_session_t *eap_session, char const *virtual_server)
+{
+	rlm_rcode_t	rcode;
+
+	rad_assert(!eap_session->subrequest);
+
+	eap_virtual_server_init(request, fake, eap_session, virtual_server);
+
+	rcode = rad_virtual_server_child(fake);
+	if (rcode == RLM_MODULE_YIELD) {
+		RDEBUG2("Tunneled request yielded");
+		eap_session->subrequest = fake;
+		return rcode;
+	}
+
+	eap_virtual_server_done(request, fake, eap_session);
+
+	return rcode;
+}
+
+/** Continue a fake request which yielded
+ *
+ * @param request the current (real) request.
+ * @param eap_session representing the outer eap method.
+ * @param[out] fake the fake request, once it's finished.
+ * @return
+ *	- RLM_MODULE_YIELD if the fake request is still waiting for an event.
+ *	- the rcode of the last executed section in the virtual server.
+ */
+rlm_rcode_t eap_virtual_server_resume(REQUEST *request, eap_session_t *eap_session, REQUEST **fake)
+{
+	rlm_rcode_t	rcode;
+
+	rad_assert(eap_session->subrequest);
+
+	rcode = rad_virtual_server_child(eap_session->subrequest);
+	if (rcode == RLM_MODULE_YIELD) return rcode;
+
+	*fake = eap_session->subrequest;
+	eap_session->subrequest = NULL;
+
+	RDEBUG2("Tunneled request finished");
+
+	eap_virtual_server_done(request, *fake, eap_session);
 
 	return rcode;
 }
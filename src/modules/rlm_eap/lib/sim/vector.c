@@ -38,7 +38,6 @@ static int vector_gsm_from_ki(eap_session_t *eap_session, VALUE_PAIR *vps,
 {
 	REQUEST	*request = eap_session->request;
 	VALUE_PAIR *vp, *version;
-	int i;
 
 	/*
 	 *	Generate a new RAND value, and derive Kc and SRES from Ki
@@ -59,9 +58,7 @@ static int vector_gsm_from_ki(eap_session_t *eap_session, VALUE_PAIR *vps,
 		return 1;
 	}
 
-	for (i = 0; i < SIM_VECTOR_GSM_RAND_SIZE; i++) {
-		keys->gsm.vector[idx].rand[i] = fr_rand();
-	}
+	fr_rand_bytes(keys->gsm.vector[idx].rand, SIM_VECTOR_GSM_RAND_SIZE);
 
 	switch (version->vp_uint32) {
 	case 1:
@@ -338,7 +335,6 @@ static int vector_umts_from_ki(eap_session_t *eap_session, VALUE_PAIR *vps,
 {
 	REQUEST	*request = eap_session->request;
 	VALUE_PAIR *vp, *version;
-	int i;
 
 	/*
 	 *	Generate a new RAND value, and derive Kc and SRES from Ki
@@ -359,9 +355,7 @@ static int vector_umts_from_ki(eap_session_t *eap_session, VALUE_PAIR *vps,
 		return 1;
 	}
 
-	for (i = 0; i < SIM_VECTOR_UMTS_RAND_SIZE; i++) {
-		keys->umts.vector.rand[i] = fr_rand();
-	}
+	fr_rand_bytes(keys->umts.vector.rand, SIM_VECTOR_UMTS_RAND_SIZE);
 
 	switch (version->vp_uint32) {
 	case 1:
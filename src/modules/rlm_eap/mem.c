@@ -80,6 +80,8 @@ static int _eap_session_free(eap_session_t *eap_session)
 		ROPTIONAL(RWDEBUG, WARN, "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!");
 	}
 
+	eap_session_memory_release(eap_session);
+
 	ROPTIONAL(RDEBUG4, DEBUG4, "Freeing eap_session_t %p", eap_session);
 
 	return 0;
@@ -116,3 +118,88 @@ eap_session_t *eap_session_alloc(rlm_eap_t const *inst, REQUEST *request)
 
 	return eap_session;
 }
+
+/** Check whether there's memory available for a new eap_session_t
+ *
+ * and allocated their state.
+ *
+ * @param inst		of rlm_eap the session would belong to.
+ * @param request	the session would be started by.
+ * @return
+ *	- true if there's memory available, or no limit is configured.
+ *	- false if the frozen sessions are over max_memory, or the module is
+ *	  over the hard limit in its "memory" section.
+ */
+bool eap_session_memory_available(rlm_eap_t const *inst, REQUEST *request)
+{
+	if (fr_memory_limit(inst->memory) == FR_MEMORY_HARD) {
+		RERROR("Rejecting new EAP session, frozen sessions hold %zu bytes, "
+		       "max_memory is %zu bytes", fr_memory_used(inst->memory), inst->max_memory);
+		return false;
+	}
+
+	if (inst->module_memory && (fr_memory_limit(inst->module_memory) == FR_MEMORY_HARD)) {
+		RERROR("Rejecting new EAP session, module memory is over its hard limit (%zu bytes used)",
+		       fr_memory_used(inst->module_memory));
+		return false;
+	}
+
+	return true;
+}
+
+/** Account for the memory an eap_session_t holds whilst it's frozen
+ *
+ * Must be called before the eap_session_t is frozen.  The memory is released
+ * when the session is thawed or freed.
+ *
+ * Only memory allocated with talloc is counted.  OpenSSL's own allocations
+ * for TLS based methods are not.
+ *
+ * @param eap_session to account for.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the session exceeds a memory limit, and should be failed.
+ */
+int eap_session_memory_reserve(eap_session_t *eap_session)
+{
+	rlm_eap_t const	*inst = eap_session->inst;
+	REQUEST		*request = eap_session->request;
+	size_t		size;
+
+	rad_assert(eap_session->memory == 0);
+
+	size = talloc_total_size(eap_session);
+	if (inst->max_session_memory && (size > inst->max_session_memory)) {
+		RERROR("EAP session holds %zu bytes, max_session_memory is %zu bytes", size,
+		       inst->max_session_memory);
+		return -1;
+	}
+
+	if (!fr_memory_reserve(inst->memory, size)) {
+		RERROR("EAP session holds %zu bytes, which would exceed max_memory (%zu bytes)", size,
+		       inst->max_memory);
+		return -1;
+	}
+	if (inst->module_memory) fr_memory_add(inst->module_memory, size);
+
+	eap_session->memory = size;
+
+	RDEBUG4("EAP session holds %zu bytes", size);
+
+	return 0;
+}
+
+/** Release the memory accounted to an eap_session_t when it was frozen
+ *
+ * @param eap_session to release memory for.
+ */
+void eap_session_memory_release(eap_session_t *eap_session)
+{
+	rlm_eap_t const *inst = eap_session->inst;
+
+	if (!eap_session->memory) return;
+
+	fr_memory_add(inst->memory, -(int64_t) eap_session->memory);
+	if (inst->module_memory) fr_memory_add(inst->module_memory, -(int64_t) eap_session->memory);
+	eap_session->memory = 0;
+}
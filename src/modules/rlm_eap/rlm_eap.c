@@ -50,6 +50,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("cisco_accounting_username_bug", FR_TYPE_BOOL, rlm_eap_t,
 			 cisco_accounting_username_bug), .dflt = "no" },
 	{ FR_CONF_DEPRECATED("max_sessions", FR_TYPE_UINT32, rlm_eap_t, max_sessions), .dflt = "2048" },
+	{ FR_CONF_OFFSET("max_session_memory", FR_TYPE_SIZE, rlm_eap_t, max_session_memory), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_memory", FR_TYPE_SIZE, rlm_eap_t, max_memory), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -253,7 +255,6 @@ static eap_type_t eap_process_nak(rlm_eap_t *inst, REQUEST *request,
 				type_str, nak->data[i], type_str, nak->data[i]);
 
 			RWARN("!!! We requested to use EAP type %s (%i)", type_str, nak->data[i]);
-			RWARN("!!! The supplicant rejected that, and requested to use the same EAP type.");
 			RWARN("!!!     i.e. the supplicant said 'I don't like %s, please use %s instead.",
 			      type_str, type_str);
 			RWARN("!!! The supplicant software is broken and does not work properly.");
@@ -289,6 +290,43 @@ static eap_type_t eap_process_nak(rlm_eap_t *inst, REQUEST *request,
 	return method;
 }
 
+/** Call the process function of the EAP submodule handling the session
+ *
+ * @param inst Configuration data for this instance of rlm_eap.
+ * @param eap_session State data that persists over multiple rounds of EAP.
+ * @return a status code.
+ */
+static rlm_rcode_t eap_method_call(rlm_eap_t *inst, eap_session_t *eap_session)
+{
+	rlm_rcode_t		rcode;
+	char const		*caller;
+	rlm_eap_method_t	*method = &inst->methods[eap_session->type];
+	REQUEST			*request = eap_session->request;
+
+	RDEBUG2("Calling submodule %s", method->submodule->name);
+
+	caller = request->module;
+	request->module = method->submodule->name;
+	rcode = eap_session->process(method->submodule_inst->data, eap_session);
+	request->module = caller;
+
+	switch (rcode) {
+	default:
+		REDEBUG2("Failed in EAP %s (%d) session.  EAP sub-module failed",
+			 eap_type2name(eap_session->type), eap_session->type);
+		break;
+
+	case RLM_MODULE_OK:
+	case RLM_MODULE_NOOP:
+	case RLM_MODULE_UPDATED:
+	case RLM_MODULE_HANDLED:
+	case RLM_MODULE_YIELD:
+		break;
+	}
+
+	return rcode;
+}
+
 /** Select the correct callback based on a response
  *
  * Based on the EAP response from the supplicant, call the appropriate
@@ -303,8 +341,6 @@ static eap_type_t eap_process_nak(rlm_eap_t *inst, REQUEST *request,
 static rlm_rcode_t eap_method_select(rlm_eap_t *inst, eap_session_t *eap_session)
 {
 	rlm_rcode_t		rcode = RLM_MODULE_OK;
-	char const		*caller;
-	rlm_eap_method_t	*method;
 	eap_type_data_t		*type = &eap_session->this_round->response->type;
 	REQUEST			*request = eap_session->request;
 
@@ -411,74 +447,19 @@ static rlm_rcode_t eap_method_select(rlm_eap_t *inst, eap_session_t *eap_session
 		eap_session->type = type->num;
 
 	module_call:
-		method = &inst->methods[eap_session->type];
-
-		RDEBUG2("Calling submodule %s", method->submodule->name);
-
-		caller = request->module;
-		request->module = method->submodule->name;
-		rcode = eap_session->process(method->submodule_inst->data, eap_session);
-		request->module = caller;
-
-		switch (rcode) {
-		default:
-			REDEBUG2("Failed in EAP %s (%d) session.  EAP sub-module failed",
-				 eap_type2name(eap_session->type), eap_session->type);
-			break;
-
-		case RLM_MODULE_OK:
-		case RLM_MODULE_NOOP:
-		case RLM_MODULE_UPDATED:
-		case RLM_MODULE_HANDLED:
-			break;
-		}
+		rcode = eap_method_call(inst, eap_session);
 		break;
 	}
 
 	return rcode;
 }
 
-static rlm_rcode_t mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
+/** Compose the reply, and freeze the EAP session, after the submodule has run
+ *
+ */
+static rlm_rcode_t eap_authenticate_finish(rlm_eap_t *inst, eap_session_t *eap_session, rlm_rcode_t rcode)
 {
-	rlm_eap_t		*inst = talloc_get_type_abort(instance, rlm_eap_t);
-	eap_session_t		*eap_session;
-	eap_packet_raw_t	*eap_packet;
-	rlm_rcode_t		rcode;
-
-	if (!fr_pair_find_by_num(request->packet->vps, 0, FR_EAP_MESSAGE, TAG_ANY)) {
-		REDEBUG("You set 'Auth-Type = EAP' for a request that does not contain an EAP-Message attribute!");
-		return RLM_MODULE_INVALID;
-	}
-
-	/*
-	 *	Reconstruct the EAP packet from the EAP-Message
-	 *	attribute.  The relevant decoder should have already
-	 *	concatenated the fragments into a single buffer.
-	 */
-	eap_packet = eap_vp2packet(request, request->packet->vps);
-	if (!eap_packet) {
-		RPERROR("Malformed EAP Message");
-		return RLM_MODULE_FAIL;
-	}
-
-	/*
-	 *	Allocate a new eap_session, or if this request
-	 *	is part of an ongoing authentication session,
-	 *	retrieve the existing eap_session from the request
-	 *	data.
-	 */
-	eap_session = eap_session_continue(&eap_packet, inst, request);
-	if (!eap_session) {
-		REDEBUG("Failed allocating or retrieving EAP session");
-		return RLM_MODULE_INVALID;
-	}
-
-	/*
-	 *	Call an EAP submodule to process the request,
-	 *	or with simple types like Identity and NAK,
-	 *	process it ourselves.
-	 */
-	rcode = eap_method_select(inst, eap_session);
+	REQUEST			*request = eap_session->request;
 
 	/*
 	 *	The submodule failed.  Die.
@@ -516,6 +497,19 @@ static rlm_rcode_t mod_authenticate(void *instance, UNUSED void *thread, REQUEST
 	     (eap_session->this_round->request->code == FR_EAP_CODE_SUCCESS) &&
 	     (eap_session->this_round->request->type.num == 0))) {
 		talloc_free(eap_session->prev_round);
+		eap_session->prev_round = NULL;
+
+		/*
+		 *	Fail the session now, rather than holding
+		 *	on to more memory than we're allowed.
+		 */
+		if (eap_session_memory_reserve(eap_session) < 0) {
+			eap_fail(eap_session);
+			eap_session_destroy(&eap_session);
+			rcode = RLM_MODULE_REJECT;
+			goto finish;
+		}
+
 		eap_session->prev_round = eap_session->this_round;
 		eap_session->this_round = NULL;
 	} else {
@@ -563,6 +557,88 @@ finish:
 	return rcode;
 }
 
+/** Stop the tunneled request, if the EAP submodule yielded whilst running one
+ *
+ */
+static void mod_authenticate_signal(REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+				    void *ctx, fr_state_action_t action)
+{
+	eap_session_t		*eap_session = talloc_get_type_abort(ctx, eap_session_t);
+
+	if (action != FR_ACTION_DONE) return;
+
+	if (!eap_session->subrequest) return;
+
+	RDEBUG2("Cancelling tunneled request");
+	rad_virtual_server_child_cancel(eap_session->subrequest);
+	TALLOC_FREE(eap_session->subrequest);
+}
+
+/** Continue the EAP submodule, after it yielded
+ *
+ */
+static rlm_rcode_t mod_authenticate_resume(REQUEST *request, void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_eap_t		*inst = talloc_get_type_abort(instance, rlm_eap_t);
+	eap_session_t		*eap_session = talloc_get_type_abort(ctx, eap_session_t);
+	rlm_rcode_t		rcode;
+
+	rcode = eap_method_call(inst, eap_session);
+	if (rcode == RLM_MODULE_YIELD) {
+		return unlang_module_yield(request, mod_authenticate_resume, mod_authenticate_signal, eap_session);
+	}
+
+	return eap_authenticate_finish(inst, eap_session, rcode);
+}
+
+static rlm_rcode_t mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
+{
+	rlm_eap_t		*inst = talloc_get_type_abort(instance, rlm_eap_t);
+	eap_session_t		*eap_session;
+	eap_packet_raw_t	*eap_packet;
+	rlm_rcode_t		rcode;
+
+	if (!fr_pair_find_by_num(request->packet->vps, 0, FR_EAP_MESSAGE, TAG_ANY)) {
+		REDEBUG("You set 'Auth-Type = EAP' for a request that does not contain an EAP-Message attribute!");
+		return RLM_MODULE_INVALID;
+	}
+
+	/*
+	 *	Reconstruct the EAP packet from the EAP-Message
+	 *	attribute.  The relevant decoder should have already
+	 *	concatenated the fragments into a single buffer.
+	 */
+	eap_packet = eap_vp2packet(request, request->packet->vps);
+	if (!eap_packet) {
+		RPERROR("Malformed EAP Message");
+		return RLM_MODULE_FAIL;
+	}
+
+	/*
+	 *	Allocate a new eap_session, or if this request
+	 *	is part of an ongoing authentication session,
+	 *	retrieve the existing eap_session from the request
+	 *	data.
+	 */
+	eap_session = eap_session_continue(&eap_packet, inst, request);
+	if (!eap_session) {
+		REDEBUG("Failed allocating or retrieving EAP session");
+		return RLM_MODULE_INVALID;
+	}
+
+	/*
+	 *	Call an EAP submodule to process the request,
+	 *	or with simple types like Identity and NAK,
+	 *	process it ourselves.
+	 */
+	rcode = eap_method_select(inst, eap_session);
+	if (rcode == RLM_MODULE_YIELD) {
+		return unlang_module_yield(request, mod_authenticate_resume, mod_authenticate_signal, eap_session);
+	}
+
+	return eap_authenticate_finish(inst, eap_session, rcode);
+}
+
 /*
  * EAP authorization DEPENDS on other rlm authorizations,
  * to check for user existence & get their configured values.
@@ -701,6 +777,14 @@ static rlm_rcode_t mod_post_proxy(void *instance, UNUSED void *thread, REQUEST *
 		if ((eap_session->this_round->request->code == FR_EAP_CODE_REQUEST) &&
 		    (eap_session->this_round->request->type.num >= FR_EAP_MD5)) {
 			talloc_free(eap_session->prev_round);
+			eap_session->prev_round = NULL;
+
+			if (eap_session_memory_reserve(eap_session) < 0) {
+				eap_fail(eap_session);
+				eap_session_destroy(&eap_session);
+				return RLM_MODULE_REJECT;
+			}
+
 			eap_session->prev_round = eap_session->this_round;
 			eap_session->this_round = NULL;
 		} else {	/* couldn't have been LEAP, there's no tunnel */
@@ -822,7 +906,6 @@ static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *r
 	eap_packet_raw_t	*eap_packet;
 
 	/*
-	 *	Only build a failure message if something previously rejected the request
 	 */
 	vp = fr_pair_find_by_num(request->control, 0, FR_POST_AUTH_TYPE, TAG_ANY);
 
@@ -859,7 +942,6 @@ static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *r
 		return RLM_MODULE_NOOP;
 	}
 
-	REDEBUG("Request was previously rejected, inserting EAP-Failure");
 	eap_fail(eap_session);				/* Compose an EAP failure */
 	eap_session_destroy(&eap_session);		/* Free the EAP session, and dissociate it from the request */
 
@@ -877,7 +959,7 @@ static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *r
 	return RLM_MODULE_UPDATED;
 }
 
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *cs)
+static int mod_instantiate(void *instance, CONF_SECTION *cs)
 {
 	rlm_eap_t	*inst = talloc_get_type_abort(instance, rlm_eap_t);
 
@@ -886,10 +968,20 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *cs)
 	/*
 	 *	Create our own random pool.
 	 */
-	for (i = 0; i < 256; i++) inst->rand_pool.randrsl[i] = fr_rand();
+	fr_rand_bytes(inst->rand_pool.randrsl, sizeof(inst->rand_pool.randrsl));
 	fr_randinit(&inst->rand_pool, 1);
 	inst->rand_pool.randcnt = 0;
 
+	inst->memory = fr_memory_alloc(inst, "eap_session", inst->name);
+	if (!inst->memory) return -1;
+	fr_memory_limits(inst->memory, 0, inst->max_memory);
+
+	/*
+	 *	Frozen sessions also count towards the module's
+	 *	memory, so its limits apply to them.
+	 */
+	inst->module_memory = module_memory(cs);
+
 	loaded = talloc_array_length(inst->submodule_instances);
 	for (i = 0; i < loaded; i++) {
 		rlm_eap_submodule_t const	*method;
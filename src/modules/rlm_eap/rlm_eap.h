@@ -53,6 +53,12 @@ typedef struct rlm_eap {
 	bool				ignore_unknown_types;		//!< Ignore unknown types (for later proxying).
 	bool				cisco_accounting_username_bug;
 
+	size_t				max_session_memory;		//!< Maximum memory a frozen session may hold.
+	size_t				max_memory;			//!< Maximum memory all frozen sessions may hold.
+	fr_memory_t			*memory;			//!< Memory held by frozen sessions.  Its
+									//!< hard limit is max_memory.
+	fr_memory_t			*module_memory;			//!< Memory of the module, and its limits.
+
 	char const			*name;				//!< Name of this instance.
 
 	fr_randctx			rand_pool;			//!< Pool of random data.
@@ -85,5 +91,8 @@ eap_session_t 	*eap_session_continue(eap_packet_raw_t **eap_packet, rlm_eap_t co
  */
 eap_round_t	*eap_round_alloc(eap_session_t *eap_session) CC_HINT(nonnull);
 eap_session_t	*eap_session_alloc(rlm_eap_t const *inst, REQUEST *request) CC_HINT(nonnull);
+bool		eap_session_memory_available(rlm_eap_t const *inst, REQUEST *request) CC_HINT(nonnull);
+int		eap_session_memory_reserve(eap_session_t *eap_session) CC_HINT(nonnull);
+void		eap_session_memory_release(eap_session_t *eap_session) CC_HINT(nonnull);
 
 #endif /*_RLM_EAP_H*/
@@ -32,7 +32,7 @@ RCSID("$Id$")
 #include <openssl/ssl.h>
 #include <openssl/rand.h>
 
-#define RANDFILL(x) do { rad_assert(sizeof(x) % sizeof(uint32_t) == 0); for (size_t i = 0; i < sizeof(x); i += sizeof(uint32_t)) *((uint32_t *)&x[i]) = fr_rand(); } while(0)
+#define RANDFILL(x) fr_rand_bytes(x, sizeof(x))
 
 /**
  * RFC 4851 section 5.1 - EAP-FAST Authentication Phase 1: Key Derivations
@@ -690,7 +690,6 @@ packet_ready:
  */
 static rlm_rcode_t mod_session_init(void *instance, eap_session_t *eap_session)
 {
-	int			i;
 	VALUE_PAIR		*auth_challenge;
 	VALUE_PAIR		*peer_challenge;
 	mschapv2_opaque_t	*data;
@@ -731,7 +730,7 @@ static rlm_rcode_t mod_session_init(void *instance, eap_session_t *eap_session)
 		 *	Get a random challenge.
 		 */
 		p = talloc_array(auth_challenge, uint8_t, MSCHAPV2_CHALLENGE_LEN);
-		for (i = 0; i < MSCHAPV2_CHALLENGE_LEN; i++) p[i] = fr_rand();
+		fr_rand_bytes(p, MSCHAPV2_CHALLENGE_LEN);
 		fr_pair_value_memsteal(auth_challenge, p);
 	}
 	RDEBUG2("Issuing Challenge");
@@ -630,6 +630,17 @@ rlm_rcode_t eap_peap_process(eap_session_t *eap_session, tls_session_t *tls_sess
 	REQUEST *request = eap_session->request;
 	eap_round_t *eap_round = eap_session->this_round;
 
+	/*
+	 *	The tunneled request yielded, and we've been
+	 *	resumed.  Continue it.
+	 */
+	if (eap_session->subrequest) {
+		rcode = eap_virtual_server_resume(request, eap_session, &fake);
+		if (rcode == RLM_MODULE_YIELD) return rcode;
+
+		goto reply;
+	}
+
 	/*
 	 *	Just look at the buffer directly, without doing
 	 *	record_to_buff.  This lets us avoid another data copy.
@@ -882,13 +893,16 @@ rlm_rcode_t eap_peap_process(eap_session_t *eap_session, tls_session_t *tls_sess
 
 	/*
 	 *	Call authentication recursively, which will
-	 *	do PAP, CHAP, MS-CHAP, etc.
+	 *	do PAP, CHAP, MS-CHAP, etc.  The modules it
+	 *	calls may yield, in which case so do we.
 	 */
-	eap_virtual_server(request, fake, eap_session, t->virtual_server);
+	rcode = eap_virtual_server_child(request, fake, eap_session, t->virtual_server);
+	if (rcode == RLM_MODULE_YIELD) return rcode;
 
 	/*
 	 *	Decide what to do with the reply.
 	 */
+reply:
 	switch (fake->reply->code) {
 	case 0:			/* No reply code, must be proxied... */
 #ifdef WITH_PROXY
@@ -117,6 +117,12 @@ static rlm_rcode_t mod_process(void *arg, eap_session_t *eap_session)
 		peap = tls_session->opaque = peap_alloc(tls_session, inst);
 	}
 
+	/*
+	 *	The tunneled request yielded.  There's no new
+	 *	TLS data, so just continue it.
+	 */
+	if (eap_session->subrequest) goto process;
+
 	status = eap_tls_process(eap_session);
 	if ((status == EAP_TLS_INVALID) || (status == EAP_TLS_FAIL)) {
 		REDEBUG("[eap-tls process] = %s", fr_int2str(eap_tls_status_table, status, "<INVALID>"));
@@ -149,6 +155,13 @@ static rlm_rcode_t mod_process(void *arg, eap_session_t *eap_session)
 		 */
 		return RLM_MODULE_HANDLED;
 
+	/*
+	 *	A crypto thread is performing a private key
+	 *	operation, we're called again when it's done.
+	 */
+	case EAP_TLS_YIELD:
+		return RLM_MODULE_YIELD;
+
 	/*
 	 *	Handshake is done, proceed with decoding tunneled
 	 *	data.
@@ -178,8 +191,12 @@ static rlm_rcode_t mod_process(void *arg, eap_session_t *eap_session)
 	/*
 	 *	Process the PEAP portion of the request.
 	 */
+process:
 	rcode = eap_peap_process(eap_session, tls_session, inst->auth_type_eap);
 	switch (rcode) {
+	case RLM_MODULE_YIELD:
+		break;
+
 	case RLM_MODULE_REJECT:
 		eap_tls_fail(eap_session);
 		break;
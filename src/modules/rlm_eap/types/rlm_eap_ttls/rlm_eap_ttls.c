@@ -99,6 +99,12 @@ static rlm_rcode_t mod_process(void *arg, eap_session_t *eap_session)
 
 	eap_tls_session->include_length = inst->include_length;
 
+	/*
+	 *	The tunneled request yielded.  There's no new
+	 *	TLS data, so just continue it.
+	 */
+	if (eap_session->subrequest) goto process;
+
 	/*
 	 *	Process TLS layer until done.
 	 */
@@ -143,6 +149,13 @@ static rlm_rcode_t mod_process(void *arg, eap_session_t *eap_session)
 	case EAP_TLS_HANDLED:
 		return RLM_MODULE_HANDLED;
 
+	/*
+	 *	A crypto thread is performing a private key
+	 *	operation, we're called again when it's done.
+	 */
+	case EAP_TLS_YIELD:
+		return RLM_MODULE_YIELD;
+
 	/*
 	 *	Handshake is done, proceed with decoding tunneled
 	 *	data.
@@ -172,8 +185,16 @@ static rlm_rcode_t mod_process(void *arg, eap_session_t *eap_session)
 	/*
 	 *	Process the TTLS portion of the request.
 	 */
+process:
 	rcode = eap_ttls_process(eap_session, tls_session);
 	switch (rcode) {
+	/*
+	 *	The tunneled request is waiting for an event,
+	 *	we're called again when it's done.
+	 */
+	case FR_CODE_UNDEFINED:
+		return RLM_MODULE_YIELD;
+
 	case FR_CODE_ACCESS_REJECT:
 		eap_tls_fail(eap_session);
 		return RLM_MODULE_REJECT;
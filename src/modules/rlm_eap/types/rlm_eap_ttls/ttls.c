@@ -709,6 +709,9 @@ static int CC_HINT(nonnull) eap_ttls_postproxy(eap_session_t *eap_session, void
 
 /*
  *	Process the "diameter" contents of the tunneled data.
+ *
+ *	Returns FR_CODE_UNDEFINED if the tunneled request yielded,
+ *	in which case we're called again when the request is resumed.
  */
 FR_CODE eap_ttls_process(eap_session_t *eap_session, tls_session_t *tls_session)
 {
@@ -723,6 +726,20 @@ FR_CODE eap_ttls_process(eap_session_t *eap_session, tls_session_t *tls_session)
 	REQUEST			*request = eap_session->request;
 	chbind_packet_t		*chbind;
 
+	t = (ttls_tunnel_t *) tls_session->opaque;
+
+	/*
+	 *	The tunneled request yielded, and we've been
+	 *	resumed.  Continue it.
+	 */
+	if (eap_session->subrequest) {
+		if (eap_virtual_server_resume(request, eap_session, &fake) == RLM_MODULE_YIELD) {
+			return FR_CODE_UNDEFINED;
+		}
+
+		goto reply;
+	}
+
 	/*
 	 *	Just look at the buffer directly, without doing
 	 *	record_to_buff.
@@ -731,8 +748,6 @@ FR_CODE eap_ttls_process(eap_session_t *eap_session, tls_session_t *tls_session)
 	tls_session->clean_out.used = 0;
 	data = tls_session->clean_out.data;
 
-	t = (ttls_tunnel_t *) tls_session->opaque;
-
 	/*
 	 *	If there's no data, maybe this is an ACK to an
 	 *	MS-CHAP2-Success.
@@ -869,13 +884,17 @@ FR_CODE eap_ttls_process(eap_session_t *eap_session, tls_session_t *tls_session)
 
 	/*
 	 *	Call authentication recursively, which will
-	 *	do PAP, CHAP, MS-CHAP, etc.
+	 *	do PAP, CHAP, MS-CHAP, etc.  The modules it
+	 *	calls may yield, in which case so do we.
 	 */
-	eap_virtual_server(request, fake, eap_session, t->virtual_server);
+	if (eap_virtual_server_child(request, fake, eap_session, t->virtual_server) == RLM_MODULE_YIELD) {
+		return FR_CODE_UNDEFINED;
+	}
 
 	/*
 	 *	Decide what to do with the reply.
 	 */
+reply:
 	switch (fake->reply->code) {
 	case 0:			/* No reply code, must be proxied... */
 #ifdef WITH_PROXY
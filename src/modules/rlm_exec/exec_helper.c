@@ -0,0 +1,553 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file exec_helper.c
+ * @brief Run requests through persistent helper processes.
+ *
+ * Each worker thread runs a small pool of helper processes.  Requests
+ * are written to a helper's stdin, and the helper's stdout is serviced
+ * by the worker's event loop, so the request yields whilst the helper
+ * works, and nothing is forked per request.
+ *
+ * A request is the input attributes, one per line, followed by an empty
+ * line.  The response is any number of lines of output, followed by a
+ * line containing only the status code.  The status code has the same
+ * meaning as the exit code of a program run by rlm_exec.
+ *
+ * Each helper processes one request at a time.  Requests which arrive
+ * when all of a thread's helpers are busy are queued, and dispatched
+ * as helpers become free.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "rlm_exec.h"
+#include "exec_helper.h"
+
+typedef struct exec_helper exec_helper_t;
+
+/** A helper process
+ *
+ */
+struct exec_helper {
+	exec_helper_pool_t	*pool;			//!< Pool this helper belongs to.
+
+	pid_t			pid;			//!< Of the helper, or -1 if not running.
+	int			to_child;		//!< Helper's stdin.
+	int			from_child;		//!< Helper's stdout.
+
+	char			buff[4096];		//!< Partial response.
+	size_t			used;			//!< Bytes of buff used.
+
+	uint32_t		requests;		//!< Requests processed by this process.
+
+	exec_helper_req_t	*req;			//!< Request the helper is processing.
+	fr_event_timer_t const	*ev;			//!< Timeout for the current request.
+};
+
+struct exec_helper_pool {
+	rlm_exec_t const	*inst;			//!< Instance of rlm_exec.
+	fr_event_list_t		*el;			//!< Event list servicing the helpers.
+
+	exec_helper_t		**helpers;		//!< Array of helpers.
+
+	exec_helper_req_t	*head;			//!< First request waiting for a helper.
+	exec_helper_req_t	**tail;			//!< Where to add the next waiting request.
+};
+
+struct exec_helper_req {
+	exec_helper_pool_t	*pool;			//!< Pool the request was submitted to.
+	REQUEST			*request;		//!< Request to resume, or NULL if it was cancelled.
+
+	char			*msg;			//!< To write to the helper.
+
+	bool			queued;			//!< Waiting for a helper.
+	exec_helper_req_t	*next;			//!< Next request waiting for a helper.
+	exec_helper_t		*helper;		//!< Processing the request.
+
+	int			status;			//!< From the helper, or -1 on error.
+	char			*output;		//!< From the helper.
+	char const		*error;			//!< About the helper.
+};
+
+static void helper_dispatch(exec_helper_pool_t *pool);
+
+/** Record the result of a request, and resume it
+ *
+ * If the request was cancelled, there's nothing to resume, and the
+ * helper request is freed.
+ */
+static void helper_req_complete(exec_helper_req_t *hreq, int status, char const *output, char const *error)
+{
+	hreq->status = status;
+	if (output) hreq->output = talloc_typed_strdup(hreq, output);
+	if (error) hreq->error = talloc_typed_strdup(hreq, error);
+	hreq->helper = NULL;
+
+	if (!hreq->request) {
+		talloc_free(hreq);
+		return;
+	}
+
+	unlang_resumable(hreq->request);
+}
+
+/** Stop a helper process
+ *
+ * Any request the helper was processing is failed.
+ */
+static void helper_stop(exec_helper_t *helper, char const *error)
+{
+	int status;
+
+	if (helper->ev) fr_event_timer_delete(helper->pool->el, &helper->ev);
+
+	if (helper->from_child >= 0) {
+		fr_event_fd_delete(helper->pool->el, helper->from_child);
+		close(helper->from_child);
+		helper->from_child = -1;
+	}
+
+	if (helper->to_child >= 0) {
+		close(helper->to_child);
+		helper->to_child = -1;
+	}
+
+	if (helper->pid > 0) {
+		kill(helper->pid, SIGTERM);
+		rad_waitpid(helper->pid, &status);
+		helper->pid = -1;
+	}
+
+	helper->used = 0;
+	helper->requests = 0;
+
+	if (helper->req) {
+		exec_helper_req_t *hreq = helper->req;
+
+		helper->req = NULL;
+		helper_req_complete(hreq, -1, NULL, error);
+	}
+}
+
+/** Find the status line which ends a response
+ *
+ * @param[in] buff	containing the response so far.
+ * @param[out] status	from the status line.
+ * @return
+ *	- The start of the status line.
+ *	- NULL if the response isn't complete.
+ */
+static char *helper_response_end(char *buff, int *status)
+{
+	char *line, *next, *p;
+
+	for (line = buff; (next = strchr(line, '\n')) != NULL; line = next + 1) {
+		if (line == next) continue;
+
+		for (p = line; p < next; p++) if (!isdigit((int) *p)) break;
+		if (p < next) continue;
+
+		*status = atoi(line);
+		return line;
+	}
+
+	return NULL;
+}
+
+/** Read a response from a helper
+ *
+ */
+static void _helper_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	exec_helper_t		*helper = talloc_get_type_abort(uctx, exec_helper_t);
+	exec_helper_pool_t	*pool = helper->pool;
+	rlm_exec_t const	*inst = pool->inst;
+	ssize_t			slen;
+	char			*end;
+	int			status = 0;
+
+	slen = read(helper->from_child, helper->buff + helper->used, sizeof(helper->buff) - helper->used - 1);
+	if (slen < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR)) return;
+
+		ERROR("%s: Failed reading from helper: %s", inst->name, fr_syserror(errno));
+		helper_stop(helper, "Failed reading from helper");
+		helper_dispatch(pool);
+		return;
+	}
+
+	if (slen == 0) {
+		ERROR("%s: Helper exited", inst->name);
+		helper_stop(helper, "Helper exited");
+		helper_dispatch(pool);
+		return;
+	}
+
+	helper->used += slen;
+	helper->buff[helper->used] = '\0';
+
+	end = helper_response_end(helper->buff, &status);
+	if (!end) {
+		if (helper->used >= (sizeof(helper->buff) - 1)) {
+			ERROR("%s: Response from helper too long", inst->name);
+			helper_stop(helper, "Response from helper too long");
+			helper_dispatch(pool);
+		}
+		return;
+	}
+
+	if (!helper->req) {
+		ERROR("%s: Unsolicited response from helper", inst->name);
+		helper_stop(helper, NULL);
+		helper_dispatch(pool);
+		return;
+	}
+
+	if (helper->ev) fr_event_timer_delete(pool->el, &helper->ev);
+
+	{
+		exec_helper_req_t *hreq = helper->req;
+
+		/*
+		 *	Strip the newline before the status line.
+		 */
+		if (end > helper->buff) end--;
+		*end = '\0';
+
+		helper->req = NULL;
+		helper->used = 0;
+		helper_req_complete(hreq, status, helper->buff, NULL);
+	}
+
+	/*
+	 *	Recycle helpers periodically, in case they leak
+	 */
+	if (inst->helper.max_requests && (++helper->requests >= inst->helper.max_requests)) {
+		DEBUG2("%s: Helper %u has processed %u requests, restarting", inst->name,
+		       (unsigned int)helper->pid, helper->requests);
+		helper_stop(helper, NULL);
+	}
+
+	helper_dispatch(pool);
+}
+
+static void _helper_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	exec_helper_t		*helper = talloc_get_type_abort(uctx, exec_helper_t);
+	exec_helper_pool_t	*pool = helper->pool;
+
+	ERROR("%s: Error on helper pipe: %s", pool->inst->name, fr_syserror(fd_errno));
+	helper_stop(helper, "Error on helper pipe");
+	helper_dispatch(pool);
+}
+
+/** The helper took too long to respond, kill it
+ *
+ */
+static void _helper_timeout(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	exec_helper_t		*helper = talloc_get_type_abort(uctx, exec_helper_t);
+	exec_helper_pool_t	*pool = helper->pool;
+
+	helper->ev = NULL;
+
+	ERROR("%s: Helper %u timed out", pool->inst->name, (unsigned int)helper->pid);
+	helper_stop(helper, "Helper timed out");
+	helper_dispatch(pool);
+}
+
+/** Start a helper process
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int helper_start(exec_helper_t *helper)
+{
+	exec_helper_pool_t	*pool = helper->pool;
+	rlm_exec_t const	*inst = pool->inst;
+
+	helper->pid = radius_start_program(inst->helper.program, NULL, true,
+					   &helper->to_child, &helper->from_child, NULL, false);
+	if (helper->pid < 0) {
+		ERROR("%s: Failed starting helper", inst->name);
+		helper->pid = -1;
+		helper->to_child = helper->from_child = -1;
+		return -1;
+	}
+
+	fr_nonblock(helper->from_child);
+
+	if (fr_event_fd_insert(helper, pool->el, helper->from_child,
+			       _helper_read, NULL, _helper_error, helper) < 0) {
+		ERROR("%s: Failed inserting helper into event loop: %s", inst->name, fr_strerror());
+		helper_stop(helper, NULL);
+		return -1;
+	}
+
+	DEBUG2("%s: Started helper %u", inst->name, (unsigned int)helper->pid);
+
+	return 0;
+}
+
+/** Send a request to a helper
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The request has been completed.
+ */
+static int helper_send(exec_helper_t *helper, exec_helper_req_t *hreq)
+{
+	exec_helper_pool_t	*pool = helper->pool;
+	rlm_exec_t const	*inst = pool->inst;
+	char const		*p = hreq->msg, *end = hreq->msg + talloc_array_length(hreq->msg) - 1;
+	struct timeval		when;
+
+	if ((helper->pid < 0) && (helper_start(helper) < 0)) {
+		helper_req_complete(hreq, -1, NULL, "Failed starting helper");
+		return -1;
+	}
+
+	/*
+	 *	The helper reads each request before it writes the
+	 *	response, so this only blocks if it's stuck.
+	 */
+	while (p < end) {
+		ssize_t slen;
+
+		slen = write(helper->to_child, p, end - p);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+
+			ERROR("%s: Failed writing to helper: %s", inst->name, fr_syserror(errno));
+			helper_stop(helper, NULL);
+			helper_req_complete(hreq, -1, NULL, "Failed writing to helper");
+			return -1;
+		}
+		p += slen;
+	}
+
+	hreq->helper = helper;
+	helper->req = hreq;
+
+	gettimeofday(&when, NULL);
+	when.tv_sec += inst->timeout;
+	if (fr_event_timer_insert(helper, pool->el, &helper->ev, &when, _helper_timeout, helper) < 0) {
+		ERROR("%s: Failed inserting helper timeout: %s", inst->name, fr_strerror());
+	}
+
+	return 0;
+}
+
+/** Send waiting requests to idle helpers
+ *
+ */
+static void helper_dispatch(exec_helper_pool_t *pool)
+{
+	size_t i;
+
+	for (i = 0; (i < talloc_array_length(pool->helpers)) && pool->head; i++) {
+		exec_helper_t		*helper = pool->helpers[i];
+		exec_helper_req_t	*hreq;
+
+		if (helper->req) continue;
+
+		hreq = pool->head;
+		pool->head = hreq->next;
+		if (!pool->head) pool->tail = &pool->head;
+		hreq->next = NULL;
+		hreq->queued = false;
+
+		/*
+		 *	If the helper couldn't be started, or
+		 *	died, try the next request on the same
+		 *	helper.
+		 */
+		if (helper_send(helper, hreq) < 0) i--;
+	}
+}
+
+static int _helper_pool_free(exec_helper_pool_t *pool)
+{
+	exec_helper_req_t	*hreq, *next;
+	size_t			i;
+
+	for (i = 0; i < talloc_array_length(pool->helpers); i++) helper_stop(pool->helpers[i], "Module is exiting");
+
+	for (hreq = pool->head; hreq; hreq = next) {
+		next = hreq->next;
+		hreq->queued = false;
+		helper_req_complete(hreq, -1, NULL, "Module is exiting");
+	}
+	pool->head = NULL;
+	pool->tail = &pool->head;
+
+	return 0;
+}
+
+/** Allocate a pool of helpers for a worker thread
+ *
+ * Helpers are started when the first request is sent to them.
+ *
+ * @param[in] ctx	to allocate the pool in.
+ * @param[in] inst	of rlm_exec.
+ * @param[in] el	Event list of the worker thread.
+ * @return
+ *	- A new helper pool.
+ *	- NULL on error.
+ */
+exec_helper_pool_t *exec_helper_pool_alloc(TALLOC_CTX *ctx, rlm_exec_t const *inst, fr_event_list_t *el)
+{
+	exec_helper_pool_t	*pool;
+	uint32_t		i;
+
+	MEM(pool = talloc_zero(ctx, exec_helper_pool_t));
+	pool->inst = inst;
+	pool->el = el;
+	pool->tail = &pool->head;
+
+	MEM(pool->helpers = talloc_array(pool, exec_helper_t *, inst->helper.num));
+	for (i = 0; i < inst->helper.num; i++) {
+		exec_helper_t *helper;
+
+		MEM(helper = talloc_zero(pool->helpers, exec_helper_t));
+		helper->pool = pool;
+		helper->pid = -1;
+		helper->to_child = -1;
+		helper->from_child = -1;
+
+		pool->helpers[i] = helper;
+	}
+	talloc_set_destructor(pool, _helper_pool_free);
+
+	return pool;
+}
+
+/** Submit a request to a helper
+ *
+ * The request should yield.  It will be marked resumable when the helper
+ * responds, at which point #exec_helper_result should be called.
+ *
+ * @param[in] pool		of helpers belonging to this thread.
+ * @param[in] request		The current request.
+ * @param[in] input_pairs	to send to the helper.  May be NULL.
+ * @return
+ *	- A helper request on success.
+ *	- NULL on failure.
+ */
+exec_helper_req_t *exec_helper_send(exec_helper_pool_t *pool, REQUEST *request, VALUE_PAIR *input_pairs)
+{
+	exec_helper_req_t	*hreq;
+	VALUE_PAIR		*vp;
+	vp_cursor_t		cursor;
+	char			buffer[1024];
+
+	MEM(hreq = talloc_zero(pool, exec_helper_req_t));
+	hreq->pool = pool;
+	hreq->request = request;
+	hreq->status = -1;
+
+	MEM(hreq->msg = talloc_typed_strdup(hreq, ""));
+	for (vp = fr_pair_cursor_init(&cursor, &input_pairs);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		fr_pair_snprint(buffer, sizeof(buffer), vp);
+		MEM(hreq->msg = talloc_strdup_append_buffer(hreq->msg, buffer));
+		MEM(hreq->msg = talloc_strdup_append_buffer(hreq->msg, "\n"));
+	}
+	MEM(hreq->msg = talloc_strdup_append_buffer(hreq->msg, "\n"));
+
+	RDEBUG2("Sending request to helper");
+
+	hreq->queued = true;
+	*pool->tail = hreq;
+	pool->tail = &hreq->next;
+
+	helper_dispatch(pool);
+
+	return hreq;
+}
+
+/** Retrieve the result of a request sent to a helper
+ *
+ * The helper request is freed.
+ *
+ * @param[in] request	The current request.
+ * @param[in] hreq	as returned by #exec_helper_send.
+ * @param[out] out	Where to write the output of the helper.
+ * @param[in] outlen	Length of out.
+ * @return
+ *	- The status code from the helper.
+ *	- -1 on failure.
+ */
+int exec_helper_result(REQUEST *request, exec_helper_req_t *hreq, char *out, size_t outlen)
+{
+	int status = hreq->status;
+
+	*out = '\0';
+
+	if (hreq->error) {
+		REDEBUG("%s", hreq->error);
+	} else {
+		if (hreq->output) strlcpy(out, hreq->output, outlen);
+		RDEBUG2("Helper returned code (%d) and output \"%s\"", status, out);
+	}
+
+	talloc_free(hreq);
+
+	return status;
+}
+
+/** Stop waiting for a helper to respond
+ *
+ * Requests which are waiting for a helper are freed immediately.  Requests
+ * which have been sent to a helper are freed when the helper responds, so
+ * that the helper doesn't get out of sync.
+ *
+ * @param[in] hreq	to cancel.
+ */
+void exec_helper_cancel(exec_helper_req_t *hreq)
+{
+	exec_helper_pool_t	*pool = hreq->pool;
+	exec_helper_req_t	**last;
+
+	hreq->request = NULL;
+
+	if (hreq->helper) return;
+
+	if (hreq->queued) {
+		for (last = &pool->head; *last; last = &(*last)->next) {
+			if (*last != hreq) continue;
+
+			*last = hreq->next;
+			if (!*last) pool->tail = last;
+			break;
+		}
+	}
+
+	talloc_free(hreq);
+}
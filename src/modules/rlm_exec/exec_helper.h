@@ -0,0 +1,18 @@
+/* Copyright 2026 The FreeRADIUS server project */
+
+#ifndef _EXEC_HELPER_H
+#define _EXEC_HELPER_H
+
+RCSIDH(exec_helper_h, "$Id$")
+
+typedef struct exec_helper_req exec_helper_req_t;
+
+exec_helper_pool_t	*exec_helper_pool_alloc(TALLOC_CTX *ctx, rlm_exec_t const *inst, fr_event_list_t *el);
+
+exec_helper_req_t	*exec_helper_send(exec_helper_pool_t *pool, REQUEST *request, VALUE_PAIR *input_pairs);
+
+int			exec_helper_result(REQUEST *request, exec_helper_req_t *hreq, char *out, size_t outlen);
+
+void			exec_helper_cancel(exec_helper_req_t *hreq);
+
+#endif /*_EXEC_HELPER_H*/
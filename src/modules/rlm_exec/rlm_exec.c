@@ -31,23 +31,15 @@ RCSID("$Id$")
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
 
-/*
- *	Define a structure for our module configuration.
- */
-typedef struct rlm_exec_t {
-	char const	*name;
-	int		bare;
-	bool		wait;
-	char const	*program;
-	char const	*input;
-	char const	*output;
-	pair_lists_t	input_list;
-	pair_lists_t	output_list;
-	char const	*packet_type;
-	unsigned int	packet_code;
-	bool		shell_escape;
-	uint32_t	timeout;
-} rlm_exec_t;
+#include "rlm_exec.h"
+#include "exec_helper.h"
+
+static const CONF_PARSER helper_config[] = {
+	{ FR_CONF_OFFSET("program", FR_TYPE_STRING, rlm_exec_t, helper.program) },
+	{ FR_CONF_OFFSET("helpers", FR_TYPE_UINT32, rlm_exec_t, helper.num), .dflt = "2" },
+	{ FR_CONF_OFFSET("max_requests", FR_TYPE_UINT32, rlm_exec_t, helper.max_requests), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
 
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("wait", FR_TYPE_BOOL, rlm_exec_t, wait), .dflt = "yes" },
@@ -57,6 +49,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("packet_type", FR_TYPE_STRING, rlm_exec_t, packet_type) },
 	{ FR_CONF_OFFSET("shell_escape", FR_TYPE_BOOL, rlm_exec_t, shell_escape), .dflt = "yes" },
 	{ FR_CONF_OFFSET("timeout", FR_TYPE_UINT32, rlm_exec_t, timeout) },
+	{ FR_CONF_POINTER("helper", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) helper_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -234,6 +227,16 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->helper.program) {
+		if (!inst->wait) {
+			cf_log_err(conf, "Cannot use a helper if wait = no");
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("helpers", inst->helper.num, >=, 1);
+		FR_INTEGER_BOUND_CHECK("helpers", inst->helper.num, <=, 64);
+	}
+
 	/*
 	 *	Get the packet type on which to execute
 	 */
@@ -272,13 +275,111 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+/** Allocate this thread's helpers
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_exec_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_exec_t const	*inst = instance;
+	rlm_exec_thread_t	*t = thread;
+
+	if (!inst->helper.program) return 0;
+
+	t->helpers = exec_helper_pool_alloc(NULL, inst, el);
+	if (!t->helpers) return -1;
+
+	return 0;
+}
+
+/** Stop this thread's helpers
+ *
+ * @param[in] thread	specific data.
+ * @return 0.
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_exec_thread_t	*t = thread;
+
+	TALLOC_FREE(t->helpers);
+
+	return 0;
+}
+
+/** Process the response from a helper
+ *
+ */
+static rlm_rcode_t mod_exec_helper_resume(REQUEST *request, void *instance, UNUSED void *thread, void *rctx)
+{
+	rlm_exec_t const	*inst = instance;
+	exec_helper_req_t	*hreq = rctx;
+	int			status;
+	char			out[4096];
+	char			*line, *next;
+
+	status = exec_helper_result(request, hreq, out, sizeof(out));
+	if ((status < 0) || !inst->output) return rlm_exec_status2rcode(request, out, strlen(out), status);
+
+	/*
+	 *	Each line of output is a list of attributes.
+	 */
+	for (line = out; *line; line = next) {
+		VALUE_PAIR	**output_pairs, *vps = NULL;
+		TALLOC_CTX	*ctx;
+
+		next = strchr(line, '\n');
+		if (next) {
+			*next++ = '\0';
+		} else {
+			next = line + strlen(line);
+		}
+		if (!*line) continue;
+
+		output_pairs = radius_list(request, inst->output_list);
+		if (!output_pairs) return RLM_MODULE_INVALID;
+		ctx = radius_list_ctx(request, inst->output_list);
+
+		if (fr_pair_list_afrom_str(ctx, line, &vps) == T_INVALID) {
+			REDEBUG("Failed parsing output from helper: %s", fr_strerror());
+			fr_pair_list_free(&vps);
+			return RLM_MODULE_FAIL;
+		}
+
+		/*
+		 *	We want to mark the new attributes as tainted,
+		 *	but not the existing ones.
+		 */
+		fr_pair_list_tainted(vps);
+		fr_pair_add(output_pairs, vps);
+	}
+
+	return rlm_exec_status2rcode(request, out, 0, status);
+}
+
+/** Request was cancelled, stop waiting for the helper
+ *
+ */
+static void mod_exec_helper_signal(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+				   void *rctx, fr_state_action_t action)
+{
+	if (action != FR_ACTION_DONE) return;
+
+	exec_helper_cancel(rctx);
+}
 
 /*
  *  Dispatch an exec method
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_exec_dispatch(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_exec_dispatch(void *instance, void *thread, REQUEST *request)
 {
 	rlm_exec_t const	*inst = instance;
+	rlm_exec_thread_t	*t = thread;
 	rlm_rcode_t		rcode;
 	int			status;
 
@@ -290,7 +391,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_exec_dispatch(void *instance, UNUSED voi
 	/*
 	 *	We need a program to execute.
 	 */
-	if (!inst->program) {
+	if (!inst->program && !inst->helper.program) {
 		ERROR("We require a program to execute");
 		return RLM_MODULE_FAIL;
 	}
@@ -330,6 +431,19 @@ static rlm_rcode_t CC_HINT(nonnull) mod_exec_dispatch(void *instance, UNUSED voi
 		ctx = radius_list_ctx(request, inst->output_list);
 	}
 
+	/*
+	 *	Hand the request to one of this thread's helpers,
+	 *	and yield until it responds.
+	 */
+	if (t->helpers) {
+		exec_helper_req_t *hreq;
+
+		hreq = exec_helper_send(t->helpers, request, inst->input ? *input_pairs : NULL);
+		if (!hreq) return RLM_MODULE_FAIL;
+
+		return unlang_module_yield(request, mod_exec_helper_resume, mod_exec_helper_signal, hreq);
+	}
+
 	/*
 	 *	This function does it's own xlat of the input program
 	 *	to execute.
@@ -375,7 +489,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, void *thread,
 		we_wait = true;
 	}
 	if (!vp) {
-		if (!inst->program) {
+		if (!inst->program && !inst->helper.program) {
 			return RLM_MODULE_NOOP;
 		}
 
@@ -457,12 +571,15 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, void *thread,
  */
 extern rad_module_t rlm_exec;
 rad_module_t rlm_exec = {
-	.magic		= RLM_MODULE_INIT,
-	.name		= "exec",
-	.type		= RLM_TYPE_THREAD_SAFE,
-	.inst_size	= sizeof(rlm_exec_t),
-	.config		= module_config,
-	.bootstrap	= mod_bootstrap,
+	.magic			= RLM_MODULE_INIT,
+	.name			= "exec",
+	.type			= RLM_TYPE_THREAD_SAFE,
+	.inst_size		= sizeof(rlm_exec_t),
+	.thread_inst_size	= sizeof(rlm_exec_thread_t),
+	.config			= module_config,
+	.bootstrap		= mod_bootstrap,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_exec_dispatch,
 		[MOD_AUTHORIZE]		= mod_exec_dispatch,
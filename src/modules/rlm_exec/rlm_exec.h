@@ -0,0 +1,39 @@
+/* Copyright 2026 The FreeRADIUS server project */
+
+#ifndef _RLM_EXEC_H
+#define _RLM_EXEC_H
+
+RCSIDH(rlm_exec_h, "$Id$")
+
+typedef struct exec_helper_pool exec_helper_pool_t;
+
+/*
+ *	Define a structure for our module configuration.
+ */
+typedef struct rlm_exec_t {
+	char const	*name;
+	int		bare;
+	bool		wait;
+	char const	*program;
+	char const	*input;
+	char const	*output;
+	pair_lists_t	input_list;
+	pair_lists_t	output_list;
+	char const	*packet_type;
+	unsigned int	packet_code;
+	bool		shell_escape;
+	uint32_t	timeout;
+
+	struct {
+		char const	*program;		//!< Helper to run, instead of running program for
+							//!< each request.
+		uint32_t	num;			//!< Helpers to run in each worker thread.
+		uint32_t	max_requests;		//!< Restart a helper after this many requests.
+	} helper;
+} rlm_exec_t;
+
+typedef struct rlm_exec_thread_t {
+	exec_helper_pool_t	*helpers;		//!< This thread's helpers.
+} rlm_exec_thread_t;
+
+#endif /*_RLM_EXEC_H*/
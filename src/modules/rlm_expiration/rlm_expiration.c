@@ -124,7 +124,7 @@ extern rad_module_t rlm_expiration;
 rad_module_t rlm_expiration = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "expiration",
-	.type		= RLM_TYPE_THREAD_SAFE,
+	.type		= RLM_TYPE_THREAD_SAFE | RLM_TYPE_SHADOW_SAFE,
 	.instantiate	= mod_instantiate,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
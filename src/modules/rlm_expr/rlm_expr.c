@@ -179,15 +179,41 @@ static expr_map_t map[] =
 	{0,	TOKEN_LAST}
 };
 
-static bool get_expression(REQUEST *request, char const **string, int64_t *answer, expr_token_t prev);
+/** A node in a compiled expression
+ *
+ * Operands have a token of TOKEN_INTEGER, and are either an integer,
+ * an attribute reference, or a sub-expression in brackets.
+ */
+typedef struct expr_node_t expr_node_t;
+struct expr_node_t {
+	expr_token_t	token;		//!< TOKEN_INTEGER for operands, otherwise the operator.
+
+	int64_t		value;		//!< Of an integer operand.
+	vp_tmpl_t	*vpt;		//!< Attribute operand.
+	bool		invert;		//!< Operand was prefixed with '~'.
+	bool		negative;	//!< Operand was prefixed with '-'.
+
+	expr_node_t	*lhs;		//!< LHS of an operator, or sub-expression of an operand.
+	expr_node_t	*rhs;		//!< RHS of an operator.
+};
+
+/** Instance data for an expr xlat whose expression is fixed
+ *
+ */
+typedef struct rlm_expr_xlat_inst_t {
+	expr_node_t	*root;		//!< Compiled expression.
+} rlm_expr_xlat_inst_t;
+
+static expr_node_t *compile_expression(TALLOC_CTX *ctx, char const **string, expr_token_t prev);
 
-static bool get_number(REQUEST *request, char const **string, int64_t *answer)
+static expr_node_t *compile_number(TALLOC_CTX *ctx, char const **string)
 {
-	int64_t x;
-	bool invert = false;
-	bool negative = false;
-	char const *p = *string;
-	vp_tmpl_t *vpt = NULL;
+	char const	*p = *string;
+	expr_node_t	*node;
+
+	node = talloc_zero(ctx, expr_node_t);
+	if (!node) return NULL;
+	node->token = TOKEN_INTEGER;
 
 	/*
 	 *	Look for a number.
@@ -198,7 +224,7 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 	 *	~1 == 0xff...ffe
 	 */
 	if (*p == '~') {
-		invert = true;
+		node->invert = true;
 		p++;
 	}
 
@@ -211,13 +237,13 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 	if ((*p == '0') && (p[1] == 'x')) {
 		char *end;
 
-		x = strtoul(p, &end, 16);
+		node->value = strtoul(p, &end, 16);
 		p = end;
 		goto done;
 	}
 
 	if (*p == '-') {
-		negative = true;
+		node->negative = true;
 		p++;
 	}
 
@@ -225,76 +251,21 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 	 *	Look for an attribute.
 	 */
 	if (*p == '&') {
-		int		i, max, err;
-		ssize_t		slen;
-		VALUE_PAIR	*vp;
-		vp_cursor_t cursor;
+		ssize_t slen;
 
 		p += 1;
 
-		slen = tmpl_afrom_attr_substr(request, &vpt, p, REQUEST_CURRENT, PAIR_LIST_REQUEST, false, false);
+		slen = tmpl_afrom_attr_substr(node, &node->vpt, p, REQUEST_CURRENT, PAIR_LIST_REQUEST, false, false);
 		if (slen <= 0) {
-			REDEBUG("Failed parsing attribute name '%s': %s", p, fr_strerror());
-			return false;
+			fr_strerror_printf("Failed parsing attribute name '%s': %s", p, fr_strerror());
+			goto error;
 		}
 
 		p += slen;
 
-		if (vpt->tmpl_num == NUM_COUNT) {
-			REDEBUG("Attribute count is not supported");
-			return false;
-		}
-
-		if (vpt->tmpl_num == NUM_ALL) {
-			max = 65535;
-		} else {
-			max = 1;
-		}
-
-		x = 0;
-		for (i = 0, vp = tmpl_cursor_init(&err, &cursor, request, vpt);
-		     (i < max) && (vp != NULL);
-		     i++, vp = tmpl_cursor_next(&cursor, vpt)) {
-			int64_t y;
-
-			if (vp->vp_type != FR_TYPE_UINT64) {
-				fr_value_box_t	value;
-
-				if (fr_value_box_cast(vp, &value, FR_TYPE_UINT64, NULL, &vp->data) < 0) {
-					REDEBUG("Failed converting &%.*s to an integer value: %s", (int) vpt->len,
-						vpt->name, fr_strerror());
-					return false;
-				}
-				if (value.vb_uint64 > INT64_MAX) {
-				overflow:
-					talloc_free(vpt);
-					REDEBUG("Value of &%.*s (%"PRIu64 ") would overflow a signed 64bit integer "
-						"(our internal arithmetic type)", (int)vpt->len, vpt->name, value.vb_uint64);
-					return false;
-				}
-				y = (int64_t)value.vb_uint64;
-
-				RINDENT();
-				RDEBUG3("&%.*s --> %" PRIu64, (int)vpt->len, vpt->name, y);
-				REXDENT();
-			} else {
-				if (vp->vp_uint64 > INT64_MAX) goto overflow;
-				y = (int64_t)vp->vp_uint64;
-			}
-
-			/*
-			 *	Check for overflow without actually overflowing.
-			 */
-			if ((y > 0) && (x > (int64_t) INT64_MAX - y)) goto overflow;
-
-			if ((y < 0) && (x < (int64_t) INT64_MIN - y)) goto overflow;
-
-			x += y;
-		} /* loop over all found VPs */
-
-		if (err != 0) {
-			RWDEBUG("Can't find &%.*s.  Using 0 as operand value", (int)vpt->len, vpt->name);
-			goto done;
+		if (node->vpt->tmpl_num == NUM_COUNT) {
+			fr_strerror_printf("Attribute count is not supported");
+			goto error;
 		}
 
 		goto done;
@@ -305,44 +276,103 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 	 */
 	if (*p == '(') {
 		p++;
-		if (!get_expression(request, &p, &x, TOKEN_NONE)) return false;
+		node->lhs = compile_expression(node, &p, TOKEN_NONE);
+		if (!node->lhs) goto error;
 
 		if (*p != ')') {
-			RDEBUG("No trailing ')'");
-			return false;
+			fr_strerror_printf("No trailing ')'");
+			goto error;
 		}
 		p++;
 		goto done;
 	}
 
 	if ((*p < '0') || (*p > '9')) {
-		RDEBUG2("Not a number at \"%s\"", p);
-		return false;
+		fr_strerror_printf("Not a number at \"%s\"", p);
+		goto error;
 	}
 
 	/*
 	 *  This is doing it the hard way, but it also allows
 	 *  us to increment 'p'.
 	 */
-	x = 0;
 	while ((*p >= '0') && (*p <= '9')) {
-		x *= 10;
-		x += (*p - '0');
+		node->value *= 10;
+		node->value += (*p - '0');
 		p++;
 	}
 
 done:
-	if (vpt) talloc_free(vpt);
+	*string = p;
+	return node;
 
-	if (invert) x = ~x;
+error:
+	talloc_free(node);
+	return NULL;
+}
 
-	if (negative) x = -x;
+/** Sum the values of the attributes an operand refers to
+ *
+ */
+static bool eval_attr(REQUEST *request, vp_tmpl_t const *vpt, int64_t *answer)
+{
+	int		i, max, err;
+	int64_t		x = 0;
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+
+	if (vpt->tmpl_num == NUM_ALL) {
+		max = 65535;
+	} else {
+		max = 1;
+	}
+
+	for (i = 0, vp = tmpl_cursor_init(&err, &cursor, request, vpt);
+	     (i < max) && (vp != NULL);
+	     i++, vp = tmpl_cursor_next(&cursor, vpt)) {
+		uint64_t	value;
+		int64_t		y;
+
+		if (vp->vp_type != FR_TYPE_UINT64) {
+			fr_value_box_t	box;
+
+			if (fr_value_box_cast(vp, &box, FR_TYPE_UINT64, NULL, &vp->data) < 0) {
+				REDEBUG("Failed converting &%.*s to an integer value: %s", (int) vpt->len,
+					vpt->name, fr_strerror());
+				return false;
+			}
+			value = box.vb_uint64;
+
+			RINDENT();
+			RDEBUG3("&%.*s --> %" PRIu64, (int)vpt->len, vpt->name, value);
+			REXDENT();
+		} else {
+			value = vp->vp_uint64;
+		}
+
+		if (value > INT64_MAX) {
+		overflow:
+			REDEBUG("Value of &%.*s (%"PRIu64 ") would overflow a signed 64bit integer "
+				"(our internal arithmetic type)", (int)vpt->len, vpt->name, value);
+			return false;
+		}
+		y = (int64_t)value;
+
+		/*
+		 *	Check for overflow without actually overflowing.
+		 */
+		if ((y > 0) && (x > (int64_t) INT64_MAX - y)) goto overflow;
+
+		if ((y < 0) && (x < (int64_t) INT64_MIN - y)) goto overflow;
+
+		x += y;
+	} /* loop over all found VPs */
+
+	if (err != 0) RWDEBUG("Can't find &%.*s.  Using 0 as operand value", (int)vpt->len, vpt->name);
 
-	*string = p;
 	*answer = x;
 	return true;
 }
-
 static bool calc_result(REQUEST *request, int64_t lhs, expr_token_t op, int64_t rhs, int64_t *answer)
 {
 	switch (op) {
@@ -429,7 +459,7 @@ static bool calc_result(REQUEST *request, int64_t lhs, expr_token_t op, int64_t
 	return true;
 }
 
-static bool get_operator(REQUEST *request, char const **string, expr_token_t *op)
+static bool get_operator(char const **string, expr_token_t *op)
 {
 	int		i;
 	char const	*p = *string;
@@ -457,20 +487,20 @@ static bool get_operator(REQUEST *request, char const **string, expr_token_t *op
 		return true;
 	}
 
-	RDEBUG("Expected operator at \"%s\"", p);
+	fr_strerror_printf("Expected operator at \"%s\"", p);
 	return false;
 }
 
-
-static bool get_expression(REQUEST *request, char const **string, int64_t *answer, expr_token_t prev)
+static expr_node_t *compile_expression(TALLOC_CTX *ctx, char const **string, expr_token_t prev)
 {
-	int64_t		lhs, rhs;
+	expr_node_t	*lhs, *rhs, *node;
 	char const 	*p, *op_p;
 	expr_token_t	this;
 
 	p = *string;
 
-	if (!get_number(request, &p, &lhs)) return false;
+	lhs = compile_number(ctx, &p);
+	if (!lhs) return NULL;
 
 redo:
 	while (isspace((int) *p)) p++;
@@ -479,16 +509,18 @@ redo:
 	 *	A number by itself is OK.
 	 */
 	if (!*p || (*p == ')')) {
-		*answer = lhs;
 		*string = p;
-		return true;
+		return lhs;
 	}
 
 	/*
 	 *	Peek at the operator.
 	 */
 	op_p = p;
-	if (!get_operator(request, &p, &this)) return false;
+	if (!get_operator(&p, &this)) {
+		talloc_free(lhs);
+		return NULL;
+	}
 
 	/*
 	 *	a + b + c ... = (a + b) + c ...
@@ -498,50 +530,139 @@ redo:
 	 *	care of continuing.
 	 */
 	if (precedence[this] <= precedence[prev]) {
-		*answer = lhs;
 		*string = op_p;
-		return true;
+		return lhs;
 	}
 
 	/*
 	 *	a + b * c ... = a + (b * c) ...
 	 */
-	if (!get_expression(request, &p, &rhs, this)) return false;
+	rhs = compile_expression(ctx, &p, this);
+	if (!rhs) {
+		talloc_free(lhs);
+		return NULL;
+	}
 
-	if (!calc_result(request, lhs, this, rhs, answer)) return false;
+	node = talloc_zero(ctx, expr_node_t);
+	if (!node) {
+		talloc_free(lhs);
+		talloc_free(rhs);
+		return NULL;
+	}
+	node->token = this;
+	node->lhs = talloc_steal(node, lhs);
+	node->rhs = talloc_steal(node, rhs);
 
 	/*
-	 *	There may be more to calculate.  The answer we
-	 *	calculated here is now the LHS of the lower priority
+	 *	There may be more to calculate.  The expression we
+	 *	built here is now the LHS of the lower priority
 	 *	operation which follows the current expression.  e.g.
 	 *
 	 *	a * b + c ... = (a * b) + c ...
 	 *	              =       d + c ...
 	 */
-	lhs = *answer;
+	lhs = node;
 	goto redo;
 }
 
+/** Compile an expression
+ *
+ * Attribute references are resolved when the expression is evaluated.
+ *
+ * @param[in] ctx	to allocate the expression in.
+ * @param[in] fmt	the expression.
+ * @return
+ *	- The compiled expression.
+ *	- NULL on error, with the reason in fr_strerror().
+ */
+static expr_node_t *expr_compile(TALLOC_CTX *ctx, char const *fmt)
+{
+	char const	*p = fmt;
+	expr_node_t	*root;
+
+	root = compile_expression(ctx, &p, TOKEN_NONE);
+	if (!root) return NULL;
+
+	if (*p) {
+		fr_strerror_printf("Invalid text after expression: %s", p);
+		talloc_free(root);
+		return NULL;
+	}
+
+	return root;
+}
+
+static bool expr_eval(REQUEST *request, expr_node_t const *node, int64_t *answer)
+{
+	int64_t		x;
+
+	if (node->token != TOKEN_INTEGER) {
+		int64_t lhs, rhs;
+
+		if (!expr_eval(request, node->lhs, &lhs)) return false;
+		if (!expr_eval(request, node->rhs, &rhs)) return false;
+
+		return calc_result(request, lhs, node->token, rhs, answer);
+	}
+
+	if (node->vpt) {
+		if (!eval_attr(request, node->vpt, &x)) return false;
+
+	} else if (node->lhs) {
+		if (!expr_eval(request, node->lhs, &x)) return false;
+
+	} else {
+		x = node->value;
+	}
+
+	if (node->invert) x = ~x;
+
+	if (node->negative) x = -x;
+
+	*answer = x;
+	return true;
+}
+
+/** Compile a fixed expression when the xlat is tokenized
+ *
+ */
+static int expr_xlat_instantiate(void *xlat_inst, UNUSED void *mod_inst, char const *fmt)
+{
+	rlm_expr_xlat_inst_t *inst = xlat_inst;
+
+	inst->root = expr_compile(inst, fmt);
+	if (!inst->root) return -1;
+
+	return 0;
+}
+
 /*
  *  Do xlat of strings!
  */
 static ssize_t expr_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
-			 UNUSED void const *mod_inst, UNUSED void const *xlat_inst,
+			 UNUSED void const *mod_inst, void const *xlat_inst,
 			 REQUEST *request, char const *fmt)
 {
-	int64_t		result;
-	char const 	*p;
+	rlm_expr_xlat_inst_t const	*inst = xlat_inst;
+	expr_node_t			*root = NULL;
+	int64_t				result;
+	bool				ret;
 
-	p = fmt;
-
-	if (!get_expression(request, &p, &result, TOKEN_NONE)) {
-		return -1;
+	/*
+	 *	The expression contained expansions, so it
+	 *	has to be compiled now.
+	 */
+	if (!inst) {
+		root = expr_compile(request, fmt);
+		if (!root) {
+			REDEBUG("%s", fr_strerror());
+			return -1;
+		}
 	}
 
-	if (*p) {
-		RDEBUG("Invalid text after expression: %s", p);
-		return -1;
-	}
+	ret = expr_eval(request, inst ? inst->root : root, &result);
+	talloc_free(root);
+	if (!ret) return -1;
 
 	snprintf(*out, outlen, "%lld", (long long int) result);
 	return strlen(*out);
@@ -1799,16 +1920,17 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		inst->xlat_name = cf_section_name1(conf);
 	}
 
-	xlat_register(inst, inst->xlat_name, expr_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register(inst, inst->xlat_name, expr_xlat, NULL,
+		      expr_xlat_instantiate, sizeof(rlm_expr_xlat_inst_t), XLAT_DEFAULT_BUF_LEN);
 
 	xlat_register(inst, "rand", rand_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 	xlat_register(inst, "randstr", randstr_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "urlquote", urlquote_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "urlunquote", urlunquote_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "escape", escape_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "unescape", unescape_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "tolower", tolower_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "toupper", toupper_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "urlquote", urlquote_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "urlunquote", urlunquote_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "escape", escape_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "unescape", unescape_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "tolower", tolower_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "toupper", toupper_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 	xlat_register(inst, "md5", md5_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 	xlat_register(inst, "sha1", sha1_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 #ifdef HAVE_OPENSSL_EVP_H
@@ -1820,7 +1942,7 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	xlat_register(inst, "pairs", pairs_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 
 	xlat_register(inst, "base64", base64_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "base64tohex", base64_to_hex_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "base64tohex", base64_to_hex_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 
 	xlat_register(inst, "explode", explode_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 
@@ -26,44 +26,114 @@ RCSID("$Id$")
 
 #include	<freeradius-devel/radiusd.h>
 #include	<freeradius-devel/modules.h>
+#include	<freeradius-devel/reload.h>
 
 #include	<ctype.h>
 #include	<fcntl.h>
 
+/*
+ *	One for each of the files we can read.
+ */
+#define FILES_MAX_INDEX	7
+
+/** The entries of one users file
+ *
+ */
+typedef struct {
+	fr_hash_table_t	*users;			//!< The first entry for each name.  Entries with the
+						///< same name are chained through PAIR_LIST->next.
+	PAIR_LIST	**defaults;		//!< DEFAULT entries, in file order.
+	uint32_t	num_defaults;		//!< How many DEFAULT entries there are.
+} files_index_t;
+
+/** One of the files we read
+ *
+ */
+typedef struct {
+	int		id;			//!< Which filter in the thread instance is for this file.
+	fr_reload_t	*reload;		//!< Gives us the current files_index_t.
+} files_source_t;
+
 typedef struct rlm_files_t {
+	char const *name;
 	char const *key;
+	struct timeval reload_interval;
 
 	char const *filename;
-	rbtree_t *common;
+	files_source_t *common;
 
 	/* autz */
 	char const *usersfile;
-	rbtree_t *users;
+	files_source_t *users;
 
 
 	/* authenticate */
 	char const *auth_usersfile;
-	rbtree_t *auth_users;
+	files_source_t *auth_users;
 
 	/* preacct */
 	char const *acct_usersfile;
-	rbtree_t *acct_users;
+	files_source_t *acct_users;
 
 #ifdef WITH_PROXY
 	/* pre-proxy */
 	char const *preproxy_usersfile;
-	rbtree_t *preproxy_users;
+	files_source_t *preproxy_users;
 
 	/* post-proxy */
 	char const *postproxy_usersfile;
-	rbtree_t *postproxy_users;
+	files_source_t *postproxy_users;
 #endif
 
 	/* post-authenticate */
 	char const *postauth_usersfile;
-	rbtree_t *postauth_users;
+	files_source_t *postauth_users;
+
+	files_source_t source[FILES_MAX_INDEX];	//!< All of the files which were read.
+	int num_sources;
 } rlm_files_t;
 
+/** An attribute which the check items of DEFAULT entries need to be present, or absent
+ *
+ */
+typedef struct {
+	fr_dict_attr_t const	*da;
+	uint32_t		bit;		//!< Which bit in the bitmaps is for this attribute.
+} files_attr_t;
+
+/** Bitmaps of the attributes each DEFAULT entry in one file needs
+ *
+ * An entry can only match if all of its "required" attributes are in the
+ * request, and none of its "absent" attributes are.
+ */
+typedef struct {
+	uint64_t		generation;	//!< Of the entries the filter was built for.
+	fr_hash_table_t		*attrs;		//!< files_attr_t, keyed by attribute.
+	uint32_t		num_words;	//!< Size of each bitmap, or 0 if there are no filters.
+	uint64_t		*present;	//!< Attributes in the current request.
+	uint64_t		*required;	//!< num_words for each DEFAULT entry.
+	uint64_t		*absent;	//!< num_words for each DEFAULT entry.
+} files_filter_t;
+
+/** Per-thread instance data
+ *
+ * The filters are built by the thread the first time it uses a file, and
+ * again whenever the file is reloaded.  They can't be built when the
+ * module is instantiated, because modules which are instantiated after
+ * this one can register comparisons for attributes which are used in the
+ * check items.
+ */
+typedef struct {
+	rlm_files_t const	*inst;
+	files_filter_t		*filter[FILES_MAX_INDEX];
+} rlm_files_thread_t;
+
+typedef enum {
+	FILES_CHECK_NONE = 0,			//!< The check item can match whatever is in the request.
+	FILES_CHECK_PRESENT,			//!< The attribute must be in the request.
+	FILES_CHECK_ABSENT			//!< The attribute must not be in the request.
+} files_check_t;
+
 
 /*
  *     See if a VALUE_PAIR list contains Fall-Through = Yes
@@ -87,6 +157,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("auth_usersfile", FR_TYPE_FILE_INPUT, rlm_files_t, auth_usersfile) },
 	{ FR_CONF_OFFSET("postauth_usersfile", FR_TYPE_FILE_INPUT, rlm_files_t, postauth_usersfile) },
 	{ FR_CONF_OFFSET("key", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_files_t, key) },
+	{ FR_CONF_OFFSET("reload_interval", FR_TYPE_TIMEVAL, rlm_files_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -96,22 +167,69 @@ static int pairlist_cmp(void const *a, void const *b)
 	return strcmp(((PAIR_LIST const *)a)->name, ((PAIR_LIST const *)b)->name);
 }
 
-static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
+static uint32_t pairlist_hash(void const *data)
+{
+	return fr_hash_string(((PAIR_LIST const *)data)->name);
+}
+
+static int files_attr_cmp(void const *a, void const *b)
+{
+	fr_dict_attr_t const *one = ((files_attr_t const *)a)->da;
+	fr_dict_attr_t const *two = ((files_attr_t const *)b)->da;
+
+	return (one > two) - (one < two);
+}
+
+static uint32_t files_attr_hash(void const *data)
+{
+	fr_dict_attr_t const *da = ((files_attr_t const *)data)->da;
+
+	return fr_hash(&da, sizeof(da));
+}
+
+/** Work out what a check item needs from the request
+ *
+ * This mirrors what paircompare() does with the check item.
+ */
+static files_check_t files_check_type(VALUE_PAIR const *vp)
+{
+	if ((vp->op == T_OP_SET) || (vp->op == T_OP_ADD)) return FILES_CHECK_NONE;
+
+	if (!vp->da->vendor) switch (vp->da->attr) {
+	case FR_CRYPT_PASSWORD:
+	case FR_AUTH_TYPE:
+	case FR_AUTZ_TYPE:
+	case FR_ACCT_TYPE:
+	case FR_SESSION_TYPE:
+	case FR_STRIP_USER_NAME:
+	case FR_USER_PASSWORD:
+		return FILES_CHECK_NONE;
+
+	default:
+		break;
+	}
+
+	if (paircompare_registered(vp->da)) return FILES_CHECK_NONE;
+
+	return (vp->op == T_OP_CMP_FALSE) ? FILES_CHECK_ABSENT : FILES_CHECK_PRESENT;
+}
+
+/** Read a users file, and index its entries
+ *
+ * Called when the module is instantiated, and from the reload thread.
+ */
+static void *getusersfile(TALLOC_CTX *ctx, char const *filename, UNUSED void *uctx, uint64_t *entries)
 {
 	int rcode;
 	PAIR_LIST *users = NULL;
 	PAIR_LIST *entry, *next;
-	PAIR_LIST *user_list, *default_list, **default_tail;
-	rbtree_t *tree;
-
-	if (!filename) {
-		*ptree = NULL;
-		return 0;
-	}
+	PAIR_LIST *user_list;
+	files_index_t *index;
+	uint32_t num_defaults = 0;
 
 	rcode = pairlist_read(ctx, filename, &users, 1);
 	if (rcode < 0) {
-		return -1;
+		return NULL;
 	}
 
 	/*
@@ -185,14 +303,24 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
 		}
 	}
 
-	tree = rbtree_create(ctx, pairlist_cmp, NULL, RBTREE_FLAG_NONE);
-	if (!tree) {
+	for (entry = users; entry != NULL; entry = entry->next) {
+		if (strcmp(entry->name, "DEFAULT") == 0) num_defaults++;
+		(*entries)++;
+	}
+
+	index = talloc_zero(ctx, files_index_t);
+	if (!index) {
 		pairlist_free(&users);
-		return -1;
+		return NULL;
 	}
 
-	default_list = NULL;
-	default_tail = &default_list;
+	index->users = fr_hash_table_create(index, pairlist_hash, pairlist_cmp, NULL);
+	if (num_defaults) index->defaults = talloc_array(index, PAIR_LIST *, num_defaults);
+	if (!index->users || (num_defaults && !index->defaults)) {
+		talloc_free(index);
+		pairlist_free(&users);
+		return NULL;
+	}
 
 	/*
 	 *	We've read the entries in linearly, but putting them
@@ -205,47 +333,38 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
 		 */
 		next = entry->next;
 		entry->next = NULL;
-		(void) talloc_steal(tree, entry);
+		(void) talloc_steal(index, entry);
 
 		/*
-		 *	DEFAULT entries get their own list.
+		 *	The reply items are copied into every
+		 *	matching reply, so encode the constant ones
+		 *	once, instead of once per packet.
 		 */
-		if (strcmp(entry->name, "DEFAULT") == 0) {
-			if (!default_list) {
-				default_list = entry;
+		(void) fr_radius_encode_pair_cache(entry->reply);
 
-				/*
-				 *	Insert the first DEFAULT into the tree.
-				 */
-				if (!rbtree_insert(tree, entry)) {
-				error:
-					pairlist_free(&entry);
-					pairlist_free(&next);
-					talloc_free(tree);
-					return -1;
-				}
-
-			} else {
-				/*
-				 *	Tack this entry onto the tail
-				 *	of the DEFAULT list.
-				 */
-				*default_tail = entry;
-			}
-
-			default_tail = &entry->next;
+		/*
+		 *	DEFAULT entries get their own array, so
+		 *	that the thread instances can have a filter
+		 *	for each of them.
+		 */
+		if (strcmp(entry->name, "DEFAULT") == 0) {
+			index->defaults[index->num_defaults++] = entry;
 			continue;
 		}
 
 		/*
 		 *	Not DEFAULT, must be a normal user.
 		 */
-		user_list = rbtree_finddata(tree, entry);
+		user_list = fr_hash_table_finddata(index->users, entry);
 		if (!user_list) {
 			/*
 			 *	Insert the first one.
 			 */
-			if (!rbtree_insert(tree, entry)) goto error;
+			if (!fr_hash_table_insert(index->users, entry)) {
+				pairlist_free(&next);
+				talloc_free(index);
+				return NULL;
+			}
 		} else {
 			/*
 			 *	Find the tail of this list, and add it
@@ -257,22 +376,50 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
 		}
 	}
 
-	*ptree = tree;
-
-	return 0;
+	return index;
 }
 
+/** Read a users file, and re-read it when it changes
+ *
+ */
+static int files_source_alloc(rlm_files_t *inst, char const *filename, files_source_t **psource)
+{
+	files_source_t *source;
+
+	if (!filename) {
+		*psource = NULL;
+		return 0;
+	}
 
+	if (inst->num_sources == FILES_MAX_INDEX) return -1;
+
+	source = &inst->source[inst->num_sources];
+	source->reload = fr_reload_alloc(inst, inst->name, filename, &inst->reload_interval, getusersfile, inst);
+	if (!source->reload) return -1;
+
+	source->id = inst->num_sources++;
+	*psource = source;
+
+	return 0;
+}
 
 /*
- *	(Re-)read the "users" file into memory.
+ *	Read the "users" files into memory.
  */
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	rlm_files_t *inst = instance;
 
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	if (timerisset(&inst->reload_interval)) {
+		FR_TIMEVAL_BOUND_CHECK("reload_interval", &inst->reload_interval, >=, 1, 0);
+		FR_TIMEVAL_BOUND_CHECK("reload_interval", &inst->reload_interval, <=, 86400, 0);
+	}
+
 #undef READFILE
-#define READFILE(_x, _y) do { if (getusersfile(inst, inst->_x, &inst->_y) != 0) { ERROR("Failed reading %s", inst->_x); return -1;} } while (0)
+#define READFILE(_x, _y) do { if (files_source_alloc(inst, inst->_x, &inst->_y) != 0) { ERROR("Failed reading %s", inst->_x); return -1;} } while (0)
 
 	READFILE(filename, common);
 	READFILE(usersfile, users);
@@ -289,17 +436,179 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
 	return 0;
 }
 
+/** Build the filter for the DEFAULT entries of one file
+ *
+ * Each attribute which the check items need to be present in (or absent
+ * from) the request gets a bit.  Each DEFAULT entry gets a bitmap of the
+ * attributes it needs, so most entries which can't match are skipped
+ * without looking at their check items.
+ */
+static files_filter_t *files_filter_alloc(TALLOC_CTX *ctx, files_index_t const *index, uint64_t generation)
+{
+	files_filter_t	*filter;
+	uint32_t	num_attrs = 0, i;
+
+	MEM(filter = talloc_zero(ctx, files_filter_t));
+	filter->generation = generation;
+
+	MEM(filter->attrs = fr_hash_table_create(filter, files_attr_hash, files_attr_cmp, NULL));
+
+	/*
+	 *	Give each attribute a bit.
+	 */
+	for (i = 0; i < index->num_defaults; i++) {
+		vp_cursor_t	cursor;
+		VALUE_PAIR	*vp;
+
+		for (vp = fr_pair_cursor_init(&cursor, &index->defaults[i]->check);
+		     vp;
+		     vp = fr_pair_cursor_next(&cursor)) {
+			files_attr_t	my_attr, *attr;
+
+			if (files_check_type(vp) == FILES_CHECK_NONE) continue;
+
+			my_attr.da = vp->da;
+			if (fr_hash_table_finddata(filter->attrs, &my_attr)) continue;
+
+			MEM(attr = talloc(filter, files_attr_t));
+			attr->da = vp->da;
+			attr->bit = num_attrs++;
+			MEM(fr_hash_table_insert(filter->attrs, attr));
+		}
+	}
+
+	if (!num_attrs) return filter;
+
+	filter->num_words = (num_attrs + 63) / 64;
+	MEM(filter->present = talloc_array(filter, uint64_t, filter->num_words));
+	MEM(filter->required = talloc_zero_array(filter, uint64_t, index->num_defaults * filter->num_words));
+	MEM(filter->absent = talloc_zero_array(filter, uint64_t, index->num_defaults * filter->num_words));
+
+	/*
+	 *	Set the bits for each entry.
+	 */
+	for (i = 0; i < index->num_defaults; i++) {
+		vp_cursor_t	cursor;
+		VALUE_PAIR	*vp;
+
+		for (vp = fr_pair_cursor_init(&cursor, &index->defaults[i]->check);
+		     vp;
+		     vp = fr_pair_cursor_next(&cursor)) {
+			files_attr_t	my_attr, *attr;
+			uint64_t	*bitmap;
+
+			switch (files_check_type(vp)) {
+			case FILES_CHECK_PRESENT:
+				bitmap = filter->required;
+				break;
+
+			case FILES_CHECK_ABSENT:
+				bitmap = filter->absent;
+				break;
+
+			default:
+				continue;
+			}
+
+			my_attr.da = vp->da;
+			attr = fr_hash_table_finddata(filter->attrs, &my_attr);
+			if (!rad_cond_assert(attr)) continue;
+
+			bitmap += i * filter->num_words;
+			bitmap[attr->bit / 64] |= ((uint64_t) 1) << (attr->bit % 64);
+		}
+	}
+
+	return filter;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_files_thread_t *t = talloc_get_type_abort(thread, rlm_files_thread_t);
+
+	t->inst = instance;
+
+	return 0;
+}
+
+/** Fill in the bitmap of attributes which are in the request
+ *
+ */
+static void files_filter_init(files_filter_t *filter, VALUE_PAIR *vps)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+
+	memset(filter->present, 0, filter->num_words * sizeof(filter->present[0]));
+
+	for (vp = fr_pair_cursor_init(&cursor, &vps);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		files_attr_t	my_attr, *attr;
+
+		my_attr.da = vp->da;
+		attr = fr_hash_table_finddata(filter->attrs, &my_attr);
+		if (!attr) continue;
+
+		filter->present[attr->bit / 64] |= ((uint64_t) 1) << (attr->bit % 64);
+	}
+}
+
+/** See whether a DEFAULT entry might match the request
+ *
+ * @return
+ *	- true if the check items have to be compared.
+ *	- false if the entry can't match.
+ */
+static bool files_filter_match(files_filter_t const *filter, uint32_t entry)
+{
+	uint64_t const	*required = filter->required + (entry * filter->num_words);
+	uint64_t const	*absent = filter->absent + (entry * filter->num_words);
+	uint32_t	i;
+
+	for (i = 0; i < filter->num_words; i++) {
+		if ((required[i] & ~filter->present[i]) != 0) return false;
+		if ((absent[i] & filter->present[i]) != 0) return false;
+	}
+
+	return true;
+}
+
+/** See whether any of the check items have to be expanded
+ *
+ * If not, they can be compared without copying them.
+ */
+static bool files_check_expand(VALUE_PAIR *check)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+
+	for (vp = fr_pair_cursor_init(&cursor, &check);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		if (vp->type == VT_XLAT) return true;
+	}
+
+	return false;
+}
+
 /*
  *	Common code called by everything below.
  */
-static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char const *filename, rbtree_t *tree,
+static rlm_rcode_t file_common(rlm_files_t const *inst, rlm_files_thread_t *t, REQUEST *request,
+			       char const *filename, files_source_t const *source,
 			       RADIUS_PACKET *request_packet, RADIUS_PACKET *reply_packet)
 {
 	char const	*name, *match;
-	VALUE_PAIR	*check_tmp;
+	VALUE_PAIR	*check_tmp, *check;
 	VALUE_PAIR	*reply_tmp;
 	PAIR_LIST const *user_pl, *default_pl;
-	bool		found = false;
+	files_index_t const *index;
+	files_filter_t	*filter;
+	bool		found = false, have_present = false;
+	uint32_t	default_num = 0;
+	uint64_t	generation;
 	PAIR_LIST	my_pl;
 	char		buffer[256];
 
@@ -319,21 +628,33 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 		name = len ? buffer : "NONE";
 	}
 
-	if (!tree) return RLM_MODULE_NOOP;
+	if (!source) return RLM_MODULE_NOOP;
+
+	/*
+	 *	The entries can't be freed until we're done with
+	 *	them, even if the file is reloaded.
+	 */
+	index = fr_reload_enter(source->reload, &generation);
+
+	filter = t->filter[source->id];
+	if (!filter || (filter->generation != generation)) {
+		talloc_free(filter);
+		filter = t->filter[source->id] = files_filter_alloc(t, index, generation);
+	}
 
 	my_pl.name = name;
-	user_pl = rbtree_finddata(tree, &my_pl);
-	my_pl.name = "DEFAULT";
-	default_pl = rbtree_finddata(tree, &my_pl);
+	user_pl = fr_hash_table_finddata(index->users, &my_pl);
 
 	/*
 	 *	Find the entry for the user.
 	 */
-	while (user_pl || default_pl) {
+	while (user_pl || (default_num < index->num_defaults)) {
 		vp_cursor_t cursor;
 		VALUE_PAIR *vp;
 		PAIR_LIST const *pl;
 
+		default_pl = (default_num < index->num_defaults) ? index->defaults[default_num] : NULL;
+
 		/*
 		 *	Figure out which entry to match on.
 		 */
@@ -346,7 +667,7 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 		} else if (!user_pl && default_pl) {
 			pl = default_pl;
 			match = "DEFAULT";
-			default_pl = default_pl->next;
+			default_num++;
 
 		} else if (user_pl->lineno < default_pl->lineno) {
 			pl = user_pl;
@@ -356,24 +677,57 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 		} else {
 			pl = default_pl;
 			match = "DEFAULT";
-			default_pl = default_pl->next;
+			default_num++;
 		}
 
-		check_tmp = fr_pair_list_copy(request, pl->check);
-		for (vp = fr_pair_cursor_init(&cursor, &check_tmp);
-		     vp;
-		     vp = fr_pair_cursor_next(&cursor)) {
-			if (xlat_eval_do(request, vp) < 0) {
-				RWARN("Failed parsing expanded value for check item, skipping entry: %s", fr_strerror());
+		/*
+		 *	Skip DEFAULT entries which need attributes
+		 *	the request doesn't have.
+		 */
+		if (filter->num_words && (pl == default_pl)) {
+			if (!have_present) {
+				files_filter_init(filter, request_packet->vps);
+				have_present = true;
+			}
+
+			if (!files_filter_match(filter, default_num - 1)) continue;
+		}
+
+		/*
+		 *	Check items which don't need expanding are
+		 *	compared in place, and only copied if they
+		 *	match.
+		 */
+		check_tmp = NULL;
+		check = pl->check;
+		if (files_check_expand(pl->check)) {
+			bool failed = false;
+
+			check_tmp = fr_pair_list_copy(request, pl->check);
+			for (vp = fr_pair_cursor_init(&cursor, &check_tmp);
+			     vp;
+			     vp = fr_pair_cursor_next(&cursor)) {
+				if (xlat_eval_do(request, vp) < 0) {
+					RWARN("Failed parsing expanded value for check item, skipping entry: %s",
+					      fr_strerror());
+					failed = true;
+					break;
+				}
+			}
+
+			if (failed) {
 				fr_pair_list_free(&check_tmp);
 				continue;
 			}
+			check = check_tmp;
 		}
 
-		if (paircompare(request, request_packet->vps, check_tmp, &reply_packet->vps) == 0) {
+		if (paircompare(request, request_packet->vps, check, &reply_packet->vps) == 0) {
 			RDEBUG2("Found match \"%s\" one line %d of %s", match, pl->lineno, filename);
 			found = true;
 
+			if (!check_tmp) check_tmp = fr_pair_list_copy(request, pl->check);
+
 			/* ctx may be reply or proxy */
 			reply_tmp = fr_pair_list_copy(reply_packet, pl->reply);
 			radius_pairmove(request, &reply_packet->vps, reply_tmp, true);
@@ -385,6 +739,8 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 			 */
 			if (!fall_through(pl->reply)) break;
 		}
+
+		fr_pair_list_free(&check_tmp);
 	}
 
 	/*
@@ -392,6 +748,8 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 	 */
 	fr_pair_delete_by_num(&reply_packet->vps, 0, FR_FALL_THROUGH, TAG_ANY);
 
+	fr_reload_leave(source->reload);
+
 	/*
 	 *	See if we succeeded.
 	 */
@@ -409,11 +767,12 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
  *	for this user from the database. The main code only
  *	needs to check the password, the rest is done here.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_thread_t *t = talloc_get_type_abort(thread, rlm_files_thread_t);
 
-	return file_common(inst, request, inst->filename,
+	return file_common(inst, t, request, inst->filename,
 			   inst->users ? inst->users : inst->common,
 			   request->packet, request->reply);
 }
@@ -424,49 +783,54 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
  *	config. Reply items are Not Recommended(TM) in acct_users,
  *	except for Fallthrough, which should work
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_preacct(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_preacct(void *instance, void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_thread_t *t = talloc_get_type_abort(thread, rlm_files_thread_t);
 
-	return file_common(inst, request, inst->acct_usersfile,
+	return file_common(inst, t, request, inst->acct_usersfile,
 			   inst->acct_users ? inst->acct_users : inst->common,
 			   request->packet, request->reply);
 }
 
 #ifdef WITH_PROXY
-static rlm_rcode_t CC_HINT(nonnull) mod_pre_proxy(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_pre_proxy(void *instance, void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_thread_t *t = talloc_get_type_abort(thread, rlm_files_thread_t);
 
-	return file_common(inst, request, inst->preproxy_usersfile,
+	return file_common(inst, t, request, inst->preproxy_usersfile,
 			   inst->preproxy_users ? inst->preproxy_users : inst->common,
 			   request->packet, request->proxy->packet);
 }
 
-static rlm_rcode_t CC_HINT(nonnull) mod_post_proxy(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_post_proxy(void *instance, void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_thread_t *t = talloc_get_type_abort(thread, rlm_files_thread_t);
 
-	return file_common(inst, request, inst->postproxy_usersfile,
+	return file_common(inst, t, request, inst->postproxy_usersfile,
 			   inst->postproxy_users ? inst->postproxy_users : inst->common,
 			   request->proxy->reply, request->reply);
 }
 #endif
 
-static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_thread_t *t = talloc_get_type_abort(thread, rlm_files_thread_t);
 
-	return file_common(inst, request, inst->auth_usersfile,
+	return file_common(inst, t, request, inst->auth_usersfile,
 			   inst->auth_users ? inst->auth_users : inst->common,
 			   request->packet, request->reply);
 }
 
-static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_thread_t *t = talloc_get_type_abort(thread, rlm_files_thread_t);
 
-	return file_common(inst, request, inst->postauth_usersfile,
+	return file_common(inst, t, request, inst->postauth_usersfile,
 			   inst->postauth_users ? inst->postauth_users : inst->common,
 			   request->packet, request->reply);
 }
@@ -477,9 +841,12 @@ extern rad_module_t rlm_files;
 rad_module_t rlm_files = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "files",
+	.type		= RLM_TYPE_SHADOW_SAFE,
 	.inst_size	= sizeof(rlm_files_t),
+	.thread_inst_size	= sizeof(rlm_files_thread_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
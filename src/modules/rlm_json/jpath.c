@@ -399,6 +399,193 @@ int fr_jpath_evaluate_leaf(TALLOC_CTX *ctx, fr_value_box_t **out,
 	return jpath_evaluate(ctx, &tail, dst_type, dst_enumv, root, jpath->next);
 }
 
+/** A step in a jpath selection plan
+ *
+ * A plan is a tree of the field and array index selectors which jpath
+ * expressions start with.  Expressions which start with the same
+ * selectors share the same steps, so a walk of the plan looks up each
+ * selector once, for all the expressions.
+ */
+struct fr_jpath_plan {
+	jpath_selector_t const	*selector;	//!< To get from the parent step to this one.
+						//!< NULL for the root of the plan.
+	fr_jpath_plan_t		*children;	//!< Steps from this one.
+	fr_jpath_plan_t		*next;		//!< Next step from the parent.
+
+	uint32_t		*entries;	//!< Expressions whose shared selectors end here.
+	uint32_t		num_entries;	//!< Number of expressions in entries.
+
+	uint32_t		count;		//!< Number of expressions in the plan.  Root only.
+};
+
+/** Whether a node selects exactly one child, so can be a step in a plan
+ *
+ */
+static bool jpath_node_is_step(fr_jpath_node_t const *node)
+{
+	if (node->selector->next) return false;
+
+	switch (node->selector->type) {
+	case JPATH_SELECTOR_FIELD:
+		return true;
+
+	case JPATH_SELECTOR_INDEX:
+		return (node->selector->slice[0] >= 0);
+
+	default:
+		return false;
+	}
+}
+
+static bool jpath_selector_cmp(jpath_selector_t const *a, jpath_selector_t const *b)
+{
+	if (a->type != b->type) return false;
+
+	if (a->type == JPATH_SELECTOR_FIELD) return (strcmp(a->field, b->field) == 0);
+
+	return (a->slice[0] == b->slice[0]);
+}
+
+/** Add a jpath expression to a plan
+ *
+ * The expression must not be freed before the plan.
+ *
+ * @param[in] ctx	to allocate the plan in, if *plan is NULL.
+ * @param[in,out] plan	to add the expression to.  Allocated if NULL.
+ * @param[in] jpath	to add.
+ * @param[out] rest	the part of the expression after the selectors it shares
+ *			with the plan.  Pass to #fr_jpath_evaluate_rest.
+ * @return the index of the expression in the array written by #fr_jpath_plan_evaluate.
+ */
+uint32_t fr_jpath_plan_add(TALLOC_CTX *ctx, fr_jpath_plan_t **plan, fr_jpath_node_t const *jpath,
+			   fr_jpath_node_t const **rest)
+{
+	fr_jpath_plan_t		*step, *child;
+	fr_jpath_node_t const	*node;
+	uint32_t		idx;
+
+	if (!*plan) MEM(*plan = talloc_zero(ctx, fr_jpath_plan_t));
+	step = *plan;
+
+	rad_assert((jpath->selector->type == JPATH_SELECTOR_ROOT) ||
+		   (jpath->selector->type == JPATH_SELECTOR_CURRENT));
+
+	for (node = jpath->next; node && jpath_node_is_step(node); node = node->next) {
+		for (child = step->children; child; child = child->next) {
+			if (jpath_selector_cmp(child->selector, node->selector)) break;
+		}
+
+		if (!child) {
+			MEM(child = talloc_zero(step, fr_jpath_plan_t));
+			child->selector = node->selector;
+			child->next = step->children;
+			step->children = child;
+		}
+
+		step = child;
+	}
+
+	idx = (*plan)->count++;
+
+	MEM(step->entries = talloc_realloc(step, step->entries, uint32_t, step->num_entries + 1));
+	step->entries[step->num_entries++] = idx;
+
+	*rest = node;
+
+	return idx;
+}
+
+/** Return the number of expressions in a plan
+ *
+ */
+uint32_t fr_jpath_plan_count(fr_jpath_plan_t const *plan)
+{
+	return plan ? plan->count : 0;
+}
+
+static void jpath_plan_walk(fr_jpath_plan_t const *step, json_object *object, fr_jpath_start_t *starts)
+{
+	fr_jpath_plan_t const	*child;
+	uint32_t		i;
+
+	for (i = 0; i < step->num_entries; i++) {
+		starts[step->entries[i]].object = object;
+		starts[step->entries[i]].found = true;
+	}
+
+	for (child = step->children; child; child = child->next) {
+		json_object *next;
+
+		switch (child->selector->type) {
+		case JPATH_SELECTOR_FIELD:
+			if (!fr_json_object_is_type(object, json_type_object)) continue;
+			if (!json_object_object_get_ex(object, child->selector->field, &next)) continue;
+			break;
+
+		case JPATH_SELECTOR_INDEX:
+		{
+			struct array_list *array_obj;
+
+			if (!fr_json_object_is_type(object, json_type_array)) continue;
+			array_obj = json_object_get_array(object);
+			if (child->selector->slice[0] >= array_obj->length) continue;
+
+			next = array_obj->array[child->selector->slice[0]];
+		}
+			break;
+
+		default:
+			rad_assert(0);
+			continue;
+		}
+
+		jpath_plan_walk(child, next, starts);
+	}
+}
+
+/** Walk a document once, finding where the rest of each expression in a plan starts
+ *
+ * @param[in] plan	to walk.
+ * @param[in] root	of the json-c tree.
+ * @param[out] starts	array of #fr_jpath_plan_count entries.
+ */
+void fr_jpath_plan_evaluate(fr_jpath_plan_t const *plan, json_object *root, fr_jpath_start_t *starts)
+{
+	if (!plan) return;
+
+	memset(starts, 0, sizeof(*starts) * plan->count);
+
+	if (!root) return;
+
+	jpath_plan_walk(plan, root, starts);
+}
+
+/** Evaluate the rest of a jpath expression, from where the plan left off
+ *
+ * @param[in,out] ctx to allocate fr_value_box_t in.
+ * @param[out] out Where to write fr_value_box_t.
+ * @param[in] dst_type FreeRADIUS type to convert to.
+ * @param[in] dst_enumv Enumeration values to allow string to integer conversions.
+ * @param[in] start written by #fr_jpath_plan_evaluate.
+ * @param[in] rest of the jpath expression, written by #fr_jpath_plan_add.
+ * @return
+ *	- 1 on match.
+ *	- 0 on no match.
+ *	- -1 on error.
+ */
+int fr_jpath_evaluate_rest(TALLOC_CTX *ctx, fr_value_box_t **out,
+			   fr_type_t dst_type, fr_dict_attr_t const *dst_enumv,
+			   fr_jpath_start_t const *start, fr_jpath_node_t const *rest)
+{
+	fr_value_box_t **tail = out;
+
+	*tail = NULL;
+
+	if (!start->found) return 0;
+
+	return jpath_evaluate(ctx, &tail, dst_type, dst_enumv, start->object, rest);
+}
+
 /** Print a node list to a string for debugging
  *
  * Will not be identical to the original parsed string, but should be sufficient
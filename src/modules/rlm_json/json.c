@@ -165,6 +165,293 @@ json_object *json_object_from_value_box(TALLOC_CTX *ctx, fr_value_box_t const *d
 	}
 }
 
+/*
+ *	Streaming JSON encoder
+ *
+ *	Output is written directly into a talloced buffer, which is
+ *	grown as needed, instead of building a tree of json-c objects
+ *	and then printing it.
+ */
+typedef struct json_buf {
+	char		*buf;		//!< Output.  Always \0 terminated.
+	size_t		len;		//!< Length of the data in buf.
+} json_buf_t;
+
+static char const json_hextab[] = "0123456789abcdef";
+
+/*
+ *	Characters which must be escaped in JSON strings.  The value is
+ *	the character to write after the '\', or 'u' for \u00XX.
+ */
+static char const json_escape_chars[UINT8_MAX + 1] = {
+	[0x00] = 'u', [0x01] = 'u', [0x02] = 'u', [0x03] = 'u',
+	[0x04] = 'u', [0x05] = 'u', [0x06] = 'u', [0x07] = 'u',
+	['\b'] = 'b', ['\t'] = 't', ['\n'] = 'n', [0x0b] = 'u',
+	['\f'] = 'f', ['\r'] = 'r', [0x0e] = 'u', [0x0f] = 'u',
+	[0x10] = 'u', [0x11] = 'u', [0x12] = 'u', [0x13] = 'u',
+	[0x14] = 'u', [0x15] = 'u', [0x16] = 'u', [0x17] = 'u',
+	[0x18] = 'u', [0x19] = 'u', [0x1a] = 'u', [0x1b] = 'u',
+	[0x1c] = 'u', [0x1d] = 'u', [0x1e] = 'u', [0x1f] = 'u',
+	['"'] = '"', ['\\'] = '\\'
+};
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/** Return the number of bytes at the start of in which don't need escaping
+ *
+ * Checks 16 bytes at a time.
+ */
+static inline size_t json_escape_span(uint8_t const *in, size_t inlen)
+{
+	__m128i const	quote = _mm_set1_epi8('"');
+	__m128i const	backslash = _mm_set1_epi8('\\');
+	__m128i const	control = _mm_set1_epi8(0x1f);
+	size_t		i = 0;
+
+	while ((i + 16) <= inlen) {
+		__m128i		v = _mm_loadu_si128((__m128i const *)(in + i));
+		uint32_t	match;
+
+		/*
+		 *	max(v, 0x1f) == 0x1f is an unsigned v <= 0x1f.
+		 */
+		match = (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+									       _mm_cmpeq_epi8(v, backslash)),
+								 _mm_cmpeq_epi8(_mm_max_epu8(v, control), control)));
+		if (match) return i + __builtin_ctz(match);
+
+		i += 16;
+	}
+
+	while ((i < inlen) && !json_escape_chars[in[i]]) i++;
+
+	return i;
+}
+#else
+/*
+ *	Portable version, which checks 8 bytes at a time.
+ */
+#define MSBS (0x8080808080808080ULL)
+#define LSBS (0x0101010101010101ULL)
+
+/*
+ *	Non-zero if any byte of the word is less than n, for n <= 128.
+ */
+static inline uint64_t word_has_less(uint64_t word, uint8_t n)
+{
+	return (word - (LSBS * n)) & ~word & MSBS;
+}
+
+static inline size_t json_escape_span(uint8_t const *in, size_t inlen)
+{
+	size_t		i = 0;
+
+	while ((i + 8) <= inlen) {
+		uint64_t word;
+
+		memcpy(&word, in + i, sizeof(word));
+		if (word_has_less(word, 0x20) ||
+		    word_has_less(word ^ (LSBS * '"'), 1) ||
+		    word_has_less(word ^ (LSBS * '\\'), 1)) break;
+
+		i += 8;
+	}
+
+	while ((i < inlen) && !json_escape_chars[in[i]]) i++;
+
+	return i;
+}
+#endif
+
+/** Make space for at least need more bytes in the output buffer
+ *
+ * @return where to write them.
+ */
+static char *json_buf_reserve(json_buf_t *out, size_t need)
+{
+	size_t size = talloc_array_length(out->buf);
+
+	if ((out->len + need + 1) > size) {
+		size *= 2;
+		if (size < (out->len + need + 1)) size = out->len + need + 1;
+
+		MEM(out->buf = talloc_realloc(NULL, out->buf, char, size));
+	}
+
+	return out->buf + out->len;
+}
+
+static void json_buf_add(json_buf_t *out, char const *in, size_t inlen)
+{
+	memcpy(json_buf_reserve(out, inlen), in, inlen);
+	out->len += inlen;
+	out->buf[out->len] = '\0';
+}
+
+#define json_buf_add_literal(_out, _lit) json_buf_add(_out, _lit, sizeof(_lit) - 1)
+
+/** Add a string to the output buffer, escaped, and in quotes
+ *
+ */
+static void json_buf_add_string(json_buf_t *out, char const *in, size_t inlen)
+{
+	uint8_t const	*p = (uint8_t const *)in;
+	uint8_t const	*end = p + inlen;
+
+	/*
+	 *	Most strings need little or no escaping, so reserve
+	 *	enough for the whole string up front.
+	 */
+	json_buf_reserve(out, inlen + 2);
+	json_buf_add_literal(out, "\"");
+
+	while (p < end) {
+		size_t	span;
+		char	*q;
+
+		span = json_escape_span(p, end - p);
+		if (span) {
+			json_buf_add(out, (char const *)p, span);
+			p += span;
+			if (p == end) break;
+		}
+
+		q = json_buf_reserve(out, 6);
+		*q++ = '\\';
+		*q = json_escape_chars[*p];
+		if (*q == 'u') {
+			*q++ = 'u';
+			*q++ = '0';
+			*q++ = '0';
+			*q++ = json_hextab[*p >> 4];
+			*q = json_hextab[*p & 0x0f];
+		}
+		out->len = (q + 1) - out->buf;
+		p++;
+	}
+
+	json_buf_add_literal(out, "\"");
+}
+
+/** Add a value to the output buffer
+ *
+ * Integers and booleans are written as JSON numbers and booleans,
+ * everything else is printed, and written as a string.
+ */
+static void json_buf_add_value(json_buf_t *out, fr_value_box_t const *data)
+{
+	char	buffer[128];
+	char	*p;
+	size_t	len;
+
+	switch (data->type) {
+	case FR_TYPE_STRING:
+		json_buf_add_string(out, data->vb_strvalue, data->datum.length);
+		return;
+
+	case FR_TYPE_BOOL:
+		if (data->datum.boolean) {
+			json_buf_add_literal(out, "true");
+		} else {
+			json_buf_add_literal(out, "false");
+		}
+		return;
+
+	case FR_TYPE_UINT8:
+		len = snprintf(buffer, sizeof(buffer), "%u", (unsigned int) data->vb_uint8);
+		break;
+
+	case FR_TYPE_UINT16:
+		len = snprintf(buffer, sizeof(buffer), "%u", (unsigned int) data->vb_uint16);
+		break;
+
+	case FR_TYPE_UINT32:
+		len = snprintf(buffer, sizeof(buffer), "%u", data->vb_uint32);
+		break;
+
+	case FR_TYPE_UINT64:
+		if (data->vb_uint64 > INT64_MAX) goto do_string;	/* Too big for many JSON parsers */
+		len = snprintf(buffer, sizeof(buffer), "%" PRIu64, data->vb_uint64);
+		break;
+
+	case FR_TYPE_INT32:
+		len = snprintf(buffer, sizeof(buffer), "%d", data->vb_int32);
+		break;
+
+	default:
+	do_string:
+		len = fr_value_box_snprint(buffer, sizeof(buffer), data, '\0');
+		if (len < sizeof(buffer)) {
+			json_buf_add_string(out, buffer, len);
+			return;
+		}
+
+		MEM(p = fr_value_box_asprint(NULL, data, '\0'));
+		json_buf_add_string(out, p, talloc_array_length(p) - 1);
+		talloc_free(p);
+		return;
+	}
+
+	json_buf_add(out, buffer, len);
+}
+
+/** Whether the value of a pair is written as a JSON string
+ *
+ * Values of attributes with tags or enumerated values are printed,
+ * so that they're written as the alias.
+ */
+static bool json_pair_is_string(VALUE_PAIR const *vp)
+{
+	if (vp->da->flags.has_tag) return true;
+
+	switch (vp->vp_type) {
+	case FR_TYPE_UINT8:
+	case FR_TYPE_UINT16:
+	case FR_TYPE_UINT32:
+		return vp->da->flags.has_value;
+
+	case FR_TYPE_UINT64:
+		return (vp->vp_uint64 > INT64_MAX);
+
+	case FR_TYPE_INT32:
+		return false;
+
+	default:
+		return true;
+	}
+}
+
+/** Add the value of a pair to the output buffer
+ *
+ */
+static void json_buf_add_pair(json_buf_t *out, VALUE_PAIR const *vp)
+{
+	char	buffer[128];
+	char	*p;
+	size_t	len;
+
+	if (!json_pair_is_string(vp)) {
+		json_buf_add_value(out, &vp->data);
+		return;
+	}
+
+	if (vp->vp_type == FR_TYPE_STRING) {
+		json_buf_add_string(out, vp->vp_strvalue, vp->vp_length);
+		return;
+	}
+
+	len = fr_pair_value_snprint(buffer, sizeof(buffer), vp, '\0');
+	if (len < sizeof(buffer)) {
+		json_buf_add_string(out, buffer, len);
+		return;
+	}
+
+	MEM(p = fr_pair_value_asprint(NULL, vp, '\0'));
+	json_buf_add_string(out, p, talloc_array_length(p) - 1);
+	talloc_free(p);
+}
+
 /** Escapes string for use as a JSON string
  *
  * @param ctx Talloc context to allocate this string
@@ -174,26 +461,22 @@ json_object *json_object_from_value_box(TALLOC_CTX *ctx, fr_value_box_t const *d
  */
 char *fr_json_from_string(TALLOC_CTX *ctx, char const *s, bool include_quotes)
 {
-	char const *p;
-	char *out = NULL;
-	struct json_object *json;
-	int len;
+	json_buf_t	out;
+	size_t		len = strlen(s);
 
-	json = json_object_new_string(s);
-	if (!json) return NULL;
+	out.buf = talloc_array(ctx, char, len + 3);
+	if (!out.buf) return NULL;
+	out.len = 0;
 
-	if ((p = json_object_to_json_string(json))) {
-		if (include_quotes) {
-			out = talloc_strdup(ctx, p);
-		} else {
-			len = strlen(p) - 1;
-			out = talloc_strndup(ctx, p+1, len);
-			if (out) out[len-1] = '\0';
-		}
+	json_buf_add_string(&out, s, len);
+
+	if (!include_quotes) {
+		memmove(out.buf, out.buf + 1, out.len - 2);
+		out.len -= 2;
+		out.buf[out.len] = '\0';
 	}
 
-	json_object_put(json);
-	return out;
+	return out.buf;
 }
 
 /** Prints attribute as string, escaped suitably for use as JSON string
@@ -210,64 +493,68 @@ char *fr_json_from_string(TALLOC_CTX *ctx, char const *s, bool include_quotes)
  */
 size_t fr_json_from_pair(char *out, size_t outlen, VALUE_PAIR const *vp)
 {
-	size_t len, freespace = outlen;
-
-	if (!vp->da->flags.has_tag) {
-		switch (vp->vp_type) {
-		case FR_TYPE_UINT32:
-			if (vp->da->flags.has_value) break;
+	json_buf_t	tmp;
+	size_t		len;
 
-			return snprintf(out, freespace, "%u", vp->vp_uint32);
+	tmp.buf = talloc_array(NULL, char, 64);
+	if (!tmp.buf) return outlen + 1;
+	tmp.len = 0;
 
-		case FR_TYPE_UINT16:
-			if (vp->da->flags.has_value) break;
+	json_buf_add_pair(&tmp, vp);
 
-			return snprintf(out, freespace, "%u", (unsigned int) vp->vp_uint16);
+	len = tmp.len;
+	if (len < outlen) memcpy(out, tmp.buf, len + 1);
+	talloc_free(tmp.buf);
 
-		case FR_TYPE_UINT8:
-			if (vp->da->flags.has_value) break;
+	return len;
+}
 
-			return snprintf(out, freespace, "%u", (unsigned int) vp->vp_uint8);
+/** Convert a pair to a JSON object
+ *
+ * The value is converted the same way as by #fr_json_from_pair.
+ *
+ * @param[in] vp	to convert.
+ * @return a new JSON object.
+ */
+json_object *fr_json_object_from_pair(VALUE_PAIR const *vp)
+{
+	char		buffer[128];
+	char		*p;
+	json_object	*obj;
 
-		case FR_TYPE_INT32:
-			return snprintf(out, freespace, "%d", vp->vp_int32);
+	if (!json_pair_is_string(vp)) switch (vp->vp_type) {
+	case FR_TYPE_UINT8:
+		return json_object_new_int(vp->vp_uint8);
 
-		default:
-			break;
-		}
-	}
+	case FR_TYPE_UINT16:
+		return json_object_new_int(vp->vp_uint16);
 
-	if (vp->vp_type == FR_TYPE_STRING) {
-		char *tmp = fr_json_from_string(NULL, vp->vp_strvalue, true);
+#ifdef HAVE_JSON_OBJECT_NEW_INT64
+	case FR_TYPE_UINT32:
+		return json_object_new_int64(vp->vp_uint32);	/* uint32_t (max) > int32_t (max) */
 
-		/* Indicate truncation */
-		if (!tmp) return outlen + 1;
-		len = strlen(tmp);
-		if (freespace <= len) return outlen + 1;
+	case FR_TYPE_UINT64:
+		return json_object_new_int64(vp->vp_uint64);
+#endif
 
-		strcpy(out, tmp);
-		talloc_free(tmp);
+	case FR_TYPE_INT32:
+		return json_object_new_int(vp->vp_int32);
 
-		return len;
+	default:
+		break;
 	}
 
-	/* Indicate truncation */
-	if (freespace < 2) return outlen + 1;
-	*out++ = '"';
-	freespace--;
+	if (vp->vp_type == FR_TYPE_STRING) return json_object_new_string(vp->vp_strvalue);
 
-	len = fr_pair_value_snprint(out, freespace, vp, 0);
-	if (is_truncated(len, freespace)) return (outlen - freespace) + len;
-	out += len;
-	freespace -= len;
+	if (fr_pair_value_snprint(buffer, sizeof(buffer), vp, '\0') < sizeof(buffer)) {
+		return json_object_new_string(buffer);
+	}
 
-	/* Indicate truncation */
-	if (freespace < 2) return outlen + 1;
-	*out++ = '"';
-	freespace--;
-	*out = '\0'; // We don't increment out, because the nul byte should not be included in the length
+	MEM(p = fr_pair_value_asprint(NULL, vp, '\0'));
+	obj = json_object_new_string(p);
+	talloc_free(p);
 
-	return outlen - freespace;
+	return obj;
 }
 
 /** Print JSON-C version
@@ -308,94 +595,102 @@ void fr_json_version_print(void)
  *
  * @note Mapping element is only present for attributes with enumerated values.
  *
+ * The output is written directly, without building a json-c object
+ * tree.  Attribute names only contain characters allowed by the
+ * dictionary, so are written without escaping them.
+ *
  * @param[in] ctx	Talloc context.
  * @param[in] vps	a list of value pairs.
  * @param[in] prefix	The prefix to use, can be NULL to skip the prefix.
  * @return JSON string representation of the value pairs
  */
-const char *fr_json_afrom_pair_list(TALLOC_CTX *ctx, VALUE_PAIR **vps, const char *prefix)
+char *fr_json_afrom_pair_list(TALLOC_CTX *ctx, VALUE_PAIR **vps, char const *prefix)
 {
-	vp_cursor_t		cursor;
-	VALUE_PAIR 		*vp;
-	struct json_object	*obj;
-	const char		*p;
-	char			buf[FR_DICT_ATTR_MAX_NAME_LEN + 32];
-
-	MEM(obj = json_object_new_object());
-
-	for (vp = fr_pair_cursor_init(&cursor, vps); vp; vp = fr_pair_cursor_next(&cursor)) {
-		char const		*name_with_prefix;
-		fr_dict_enum_t const	*dv;
-		struct json_object	*vp_object, *values, *value, *type_name;
-
-		name_with_prefix = vp->da->name;
-		if (prefix) {
-			int len = snprintf(buf, sizeof(buf), "%s:%s", prefix, vp->da->name);
-			if (len == (int)strlen(buf)) {
-				name_with_prefix = buf;
-			}
-		}
+	json_buf_t	out;
+	VALUE_PAIR	*vp, *next, *seen;
+	char		*escaped_prefix = NULL;
+	size_t		prefix_len = 0;
+	bool		first = true;
+
+	MEM(out.buf = talloc_array(ctx, char, 1024));
+	out.len = 0;
+
+	/*
+	 *	Escape the prefix once, not once per attribute.
+	 *	It's written without the closing quote, and the
+	 *	attribute name is appended to it.
+	 */
+	if (prefix) {
+		MEM(escaped_prefix = fr_json_from_string(NULL, prefix, true));
+		prefix_len = strlen(escaped_prefix) - 1;
+	}
 
-		/*
-		 *	See if we already have a key in the table we're working on,
-		 *	if we don't, create a new one...
-		 */
-		if (!json_object_object_get_ex(obj, name_with_prefix, &vp_object)) {
-			MEM(vp_object = json_object_new_object());
-			json_object_object_add(obj, name_with_prefix, vp_object);
+	json_buf_add_literal(&out, "{");
 
-			MEM(type_name = json_object_new_string(fr_int2str(dict_attr_types, vp->vp_type, "<INVALID>")));
-			json_object_object_add(vp_object, "type", type_name);
+	for (vp = *vps; vp; vp = vp->next) {
+		char const *type;
 
-			MEM(values = json_object_new_array());
-			json_object_object_add(vp_object, "value", values);
 		/*
-		 *	If we do, get its value array...
+		 *	All instances of an attribute go in the same
+		 *	object, which was written when the first
+		 *	instance was found.
 		 */
-		} else if (!rad_cond_assert(json_object_object_get_ex(vp_object, "value", &values))) {
-			fr_strerror_printf("Inconsistent JSON tree");
-			json_object_put(obj);
+		for (seen = *vps; seen != vp; seen = seen->next) if (seen->da == vp->da) break;
+		if (seen != vp) continue;
 
-			return NULL;
+		if (!first) json_buf_add_literal(&out, ",");
+		first = false;
+
+		if (escaped_prefix) {
+			json_buf_add(&out, escaped_prefix, prefix_len);
+			json_buf_add_literal(&out, ":");
+		} else {
+			json_buf_add_literal(&out, "\"");
 		}
+		json_buf_add(&out, vp->da->name, strlen(vp->da->name));
+
+		type = fr_int2str(dict_attr_types, vp->vp_type, "<INVALID>");
+		json_buf_add_literal(&out, "\":{\"type\":\"");
+		json_buf_add(&out, type, strlen(type));
+		json_buf_add_literal(&out, "\",\"value\":[");
 
-		MEM(value = json_object_from_value_box(ctx, &vp->data));
-		json_object_array_add(values, value);
+		for (next = vp; next; next = next->next) {
+			if (next->da != vp->da) continue;
+
+			if (next != vp) json_buf_add_literal(&out, ",");
+			json_buf_add_value(&out, &next->data);
+		}
+		json_buf_add_literal(&out, "]");
 
 		/*
 		 *	Add a mapping array
 		 */
 		if (vp->da->flags.has_value) {
-			struct json_object *mapping;
+			json_buf_add_literal(&out, ",\"mapping\":[");
 
-			if (!json_object_object_get_ex(vp_object, "mapping", &mapping)) {
-				MEM(mapping = json_object_new_array());
-				json_object_object_add(vp_object, "mapping", mapping);
-			}
+			for (next = vp; next; next = next->next) {
+				fr_dict_enum_t const *dv;
+
+				if (next->da != vp->da) continue;
+
+				if (next != vp) json_buf_add_literal(&out, ",");
 
-			dv = fr_dict_enum_by_value(NULL, vp->da, &vp->data);
-			if (dv) {
-				struct json_object *mapped_value;
-
-				/* Add to mapping array */
-				MEM(mapped_value = json_object_new_string(dv->alias));
-				json_object_array_add(mapping, mapped_value);
-			/*
-			 *	Add NULL value to mapping array
-			 */
-			} else {
-				if (json_object_object_get_ex(vp_object, "mapping", &mapping)) {
-					json_object_array_add(mapping, NULL);
+				dv = fr_dict_enum_by_value(NULL, next->da, &next->data);
+				if (dv) {
+					json_buf_add_string(&out, dv->alias, strlen(dv->alias));
+				} else {
+					json_buf_add_literal(&out, "null");
 				}
 			}
+			json_buf_add_literal(&out, "]");
 		}
+
+		json_buf_add_literal(&out, "}");
 	}
 
-	MEM(p = json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN));
-	MEM(p = talloc_strdup(ctx, p));
+	json_buf_add_literal(&out, "}");
 
-	json_object_put(obj);	/* Should also free string buff from above */
+	talloc_free(escaped_prefix);
 
-	return p;
+	return out.buf;
 }
-
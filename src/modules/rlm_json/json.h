@@ -45,6 +45,15 @@ RCSIDH(json_h, "$Id$")
 
 /* jpath .c */
 typedef struct fr_jpath_node fr_jpath_node_t;
+typedef struct fr_jpath_plan fr_jpath_plan_t;
+
+/** Where the rest of a jpath expression in a plan starts
+ *
+ */
+typedef struct fr_jpath_start {
+	json_object		*object;	//!< May be NULL for JSON null values.
+	bool			found;		//!< Whether the selectors in the plan matched.
+} fr_jpath_start_t;
 
 size_t		fr_jpath_escape_func(UNUSED REQUEST *request, char *out, size_t outlen,
 				     char const *in, UNUSED void *arg);
@@ -53,6 +62,17 @@ int		fr_jpath_evaluate_leaf(TALLOC_CTX *ctx, fr_value_box_t **out,
 				       fr_type_t dst_type, fr_dict_attr_t const *dst_enumv,
 				       json_object *root, fr_jpath_node_t const *jpath);
 
+uint32_t	fr_jpath_plan_add(TALLOC_CTX *ctx, fr_jpath_plan_t **plan, fr_jpath_node_t const *jpath,
+				  fr_jpath_node_t const **rest);
+
+uint32_t	fr_jpath_plan_count(fr_jpath_plan_t const *plan);
+
+void		fr_jpath_plan_evaluate(fr_jpath_plan_t const *plan, json_object *root, fr_jpath_start_t *starts);
+
+int		fr_jpath_evaluate_rest(TALLOC_CTX *ctx, fr_value_box_t **out,
+				       fr_type_t dst_type, fr_dict_attr_t const *dst_enumv,
+				       fr_jpath_start_t const *start, fr_jpath_node_t const *rest);
+
 char		*fr_jpath_asprint(TALLOC_CTX *ctx, fr_jpath_node_t const *head);
 
 ssize_t		fr_jpath_parse(TALLOC_CTX *ctx, fr_jpath_node_t **head, char const *in, size_t inlen);
@@ -67,8 +87,10 @@ char		*fr_json_from_string(TALLOC_CTX *ctx, char const *s, bool include_quotes);
 
 size_t    	fr_json_from_pair(char *out, size_t outlen, VALUE_PAIR const *vp);
 
+json_object	*fr_json_object_from_pair(VALUE_PAIR const *vp);
+
 void		fr_json_version_print(void);
 
-const char	*fr_json_afrom_pair_list(TALLOC_CTX *ctx, VALUE_PAIR **vps, const char *prefix);
+char		*fr_json_afrom_pair_list(TALLOC_CTX *ctx, VALUE_PAIR **vps, char const *prefix);
 #endif
 #endif /* _FR_JSON_H */
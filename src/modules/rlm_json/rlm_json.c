@@ -44,14 +44,49 @@ RCSID("$Id$")
 typedef struct rlm_json_jpath_cache rlm_json_jpath_cache_t;
 struct rlm_json_jpath_cache {
 	fr_jpath_node_t		*jpath;		//!< First node in jpath expression.
+	fr_jpath_node_t const	*rest;		//!< Part of the expression not in the plan.
+	uint32_t		idx;		//!< Of the expression in the plan.
 	rlm_json_jpath_cache_t	*next;		//!< Next jpath cache entry.
 };
 
+/** Pre-parsed jpath expressions for a map
+ *
+ */
+typedef struct rlm_json_map_inst {
+	rlm_json_jpath_cache_t	*head;		//!< Literal jpath expressions, in map order.
+	fr_jpath_plan_t		*plan;		//!< Selectors shared by the literal expressions.
+} rlm_json_map_inst_t;
+
 typedef struct rlm_json_jpath_to_eval {
 	fr_jpath_node_t const	*jpath;
 	json_object		*root;
+
+	fr_jpath_start_t const	*start;		//!< Where the plan left off, or NULL for dynamic
+						//!< expressions, which are evaluated from root.
 } rlm_json_jpath_to_eval_t;
 
+#define RLM_JSON_DOC_CACHE_MAX	8
+
+/** A JSON document which has already been parsed for this request
+ *
+ */
+typedef struct rlm_json_doc {
+	char			*json_str;	//!< The document.
+	json_object		*root;		//!< Parsed document.
+} rlm_json_doc_t;
+
+/** Documents which have already been parsed for this request
+ *
+ * Several maps often read the same JSON, e.g. from the same
+ * attribute, so each document is only parsed once.  The documents
+ * are compared by content, so a map sees the current value of
+ * the source, even if it's been changed since the last map.
+ */
+typedef struct rlm_json_doc_cache {
+	rlm_json_doc_t		docs[RLM_JSON_DOC_CACHE_MAX];
+	uint32_t		num;
+} rlm_json_doc_cache_t;
+
 static ssize_t jsonquote_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
 			      UNUSED void const *mod_inst, UNUSED void const *xlat_inst,
 			      REQUEST *request, char const *fmt)
@@ -106,10 +141,13 @@ static ssize_t jpath_validate_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t ou
 }
 
 /** Pre-parse and validate literal jpath expressions for maps
+ *
+ * The expressions are also added to a plan, so the selectors they
+ * share are only evaluated once per document.
  *
  * @param[in] cs	#CONF_SECTION that defined the map instance.
  * @param[in] mod_inst	module instance (unused).
- * @param[in] proc_inst	the cache structure to fill.
+ * @param[in] proc_inst	the #rlm_json_map_inst_t to fill.
  * @param[in] src	Where to get the JSON data from.
  * @param[in] maps	set of maps to translate to jpaths.
  * @return
@@ -119,10 +157,10 @@ static ssize_t jpath_validate_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t ou
 static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void *mod_inst, void *proc_inst,
 				    vp_tmpl_t const *src, vp_map_t const *maps)
 {
-	rlm_json_jpath_cache_t	*cache_inst = proc_inst;
+	rlm_json_map_inst_t	*inst = proc_inst;
 	vp_map_t const		*map;
 	ssize_t			slen;
-	rlm_json_jpath_cache_t	*cache = cache_inst, **tail = &cache->next;
+	rlm_json_jpath_cache_t	*cache, **tail = &inst->head;
 
 	if (!src) {
 		cf_log_err(cs, "Missing JSON source");
@@ -144,6 +182,7 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void *mod_inst, voi
 
 		switch (map->rhs->type) {
 		case TMPL_TYPE_UNPARSED:
+			MEM(cache = talloc_zero(inst, rlm_json_jpath_cache_t));
 			p = map->rhs->name;
 			slen = fr_jpath_parse(cache, &cache->jpath, p, map->rhs->len);
 			if (slen <= 0) {
@@ -167,6 +206,7 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void *mod_inst, voi
 				cf_log_err(cp, "Right side of map must be a string");
 				return -1;
 			}
+			MEM(cache = talloc_zero(inst, rlm_json_jpath_cache_t));
 			p = map->rhs->tmpl_value.vb_strvalue;
 			slen = fr_jpath_parse(cache, &cache->jpath, p, map->rhs->tmpl_value_length);
 			if (slen <= 0) goto error;
@@ -176,17 +216,93 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void *mod_inst, voi
 			continue;
 		}
 
-		/*
-		 *	Slightly weird... This is here because our first
-		 *	list member was pre-allocated and passed to the
-		 *	instantiation callback.
-		 */
-		if (map->next) {
-			*tail = cache = talloc_zero(cache, rlm_json_jpath_cache_t);
-			tail = &cache->next;
+		cache->idx = fr_jpath_plan_add(inst, &inst->plan, cache->jpath, &cache->rest);
+
+		*tail = cache;
+		tail = &cache->next;
+	}
+
+	return 0;
+}
+
+/** Free a parsed document when the request is freed
+ *
+ */
+static int _json_doc_cache_free(rlm_json_doc_cache_t *doc_cache)
+{
+	uint32_t i;
+
+	for (i = 0; i < doc_cache->num; i++) json_object_put(doc_cache->docs[i].root);
+
+	return 0;
+}
+
+/** Parse a JSON document, or find it in the documents already parsed for this request
+ *
+ * @param[out] out	the root of the document.  Must not be modified or freed.
+ * @param[in] mod_inst	of rlm_json.  Used to find the cache.
+ * @param[in] request	The current request.
+ * @param[in] json_str	to parse.  Will be freed or parented by the cache.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the document couldn't be parsed.
+ */
+static int json_doc_parse(json_object **out, void const *mod_inst, REQUEST *request, char *json_str)
+{
+	rlm_json_doc_cache_t	*doc_cache;
+	struct json_tokener	*tok;
+	json_object		*root;
+	size_t			len = talloc_array_length(json_str) - 1;
+	uint32_t		i;
+
+	doc_cache = request_data_reference(request, mod_inst, 0);
+	if (doc_cache) for (i = 0; i < doc_cache->num; i++) {
+		rlm_json_doc_t *doc = &doc_cache->docs[i];
+
+		if (((talloc_array_length(doc->json_str) - 1) != len) || (memcmp(doc->json_str, json_str, len) != 0)) {
+			continue;
+		}
+
+		RDEBUG3("Using JSON document already parsed for this request");
+		talloc_free(json_str);
+		*out = doc->root;
+		return 0;
+	}
+
+	tok = json_tokener_new();
+	root = json_tokener_parse_ex(tok, json_str, (int)len);
+	if (!root) {
+		REMARKER(json_str, tok->char_offset, json_tokener_error_desc(json_tokener_get_error(tok)));
+		json_tokener_free(tok);
+		talloc_free(json_str);
+		return -1;
+	}
+	json_tokener_free(tok);
+
+	if (!doc_cache) {
+		MEM(doc_cache = talloc_zero(request, rlm_json_doc_cache_t));
+		talloc_set_destructor(doc_cache, _json_doc_cache_free);
+
+		if (request_data_add(request, mod_inst, 0, doc_cache, true, false, false) < 0) {
+			talloc_free(doc_cache);
+			doc_cache = NULL;
 		}
 	}
 
+	/*
+	 *	If the cache is full, the document is freed when
+	 *	the request is, and isn't reused.
+	 */
+	if (!doc_cache || (doc_cache->num >= RLM_JSON_DOC_CACHE_MAX)) {
+		MEM(doc_cache = talloc_zero(request, rlm_json_doc_cache_t));
+		talloc_set_destructor(doc_cache, _json_doc_cache_free);
+	}
+
+	doc_cache->docs[doc_cache->num].json_str = talloc_steal(doc_cache, json_str);
+	doc_cache->docs[doc_cache->num].root = root;
+	doc_cache->num++;
+
+	*out = root;
 	return 0;
 }
 
@@ -212,8 +328,13 @@ static int _json_map_proc_get_value(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *
 
 	*out = NULL;
 
-	ret = fr_jpath_evaluate_leaf(request, &head, map->lhs->tmpl_da->type, map->lhs->tmpl_da,
-			     	     to_eval->root, to_eval->jpath);
+	if (to_eval->start) {
+		ret = fr_jpath_evaluate_rest(request, &head, map->lhs->tmpl_da->type, map->lhs->tmpl_da,
+					     to_eval->start, to_eval->jpath);
+	} else {
+		ret = fr_jpath_evaluate_leaf(request, &head, map->lhs->tmpl_da->type, map->lhs->tmpl_da,
+					     to_eval->root, to_eval->jpath);
+	}
 	if (ret < 0) {
 		RPEDEBUG("Failed evaluating jpath");
 		return -1;
@@ -243,7 +364,7 @@ static int _json_map_proc_get_value(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *
 
 /** Parses a JSON string, and executes jpath queries against it to map values to attributes
  *
- * @param mod_inst	unused.
+ * @param mod_inst	of rlm_json.
  * @param proc_inst	cached jpath sequences.
  * @param request	The current request.
  * @param json		JSON string to parse.
@@ -253,16 +374,17 @@ static int _json_map_proc_get_value(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *
  *	- #RLM_MODULE_UPDATED if one or more #VALUE_PAIR were added to the #REQUEST.
  *	- #RLM_MODULE_FAIL if a fault occurred.
  */
-static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, REQUEST *request,
+static rlm_rcode_t mod_map_proc(void *mod_inst, void *proc_inst, REQUEST *request,
 			      	vp_tmpl_t const *json, vp_map_t const *maps)
 {
 	rlm_rcode_t			rcode = RLM_MODULE_UPDATED;
-	struct json_tokener		*tok;
 
-	rlm_json_jpath_cache_t		*cache = proc_inst;
+	rlm_json_map_inst_t		*inst = proc_inst;
+	rlm_json_jpath_cache_t		*cache = inst->head;
 	vp_map_t const			*map;
 
 	rlm_json_jpath_to_eval_t	to_eval;
+	fr_jpath_start_t		*starts = NULL;
 
 	char				*json_str = NULL;
 
@@ -270,15 +392,19 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, REQUEST
 
 	if ((talloc_array_length(json_str) - 1) == 0) {
 		REDEBUG("Zero length string is not valid JSON data");
+		talloc_free(json_str);
 		return RLM_MODULE_FAIL;
 	}
 
-	tok = json_tokener_new();
-	to_eval.root = json_tokener_parse_ex(tok, json_str, (int)(talloc_array_length(json_str) - 1));
-	if (!to_eval.root) {
-		REMARKER(json_str, tok->char_offset, json_tokener_error_desc(json_tokener_get_error(tok)));
-		rcode = RLM_MODULE_FAIL;
-		goto finish;
+	if (json_doc_parse(&to_eval.root, mod_inst, request, json_str) < 0) return RLM_MODULE_FAIL;
+
+	/*
+	 *	Walk the selectors shared by the literal
+	 *	expressions once, for all of them.
+	 */
+	if (inst->plan) {
+		MEM(starts = talloc_array(request, fr_jpath_start_t, fr_jpath_plan_count(inst->plan)));
+		fr_jpath_plan_evaluate(inst->plan, to_eval.root, starts);
 	}
 
 	for (map = maps; map; map = map->next) {
@@ -288,7 +414,8 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, REQUEST
 		 */
 		case TMPL_TYPE_UNPARSED:
 		case TMPL_TYPE_DATA:
-			to_eval.jpath = cache->jpath;
+			to_eval.jpath = cache->rest;
+			to_eval.start = &starts[cache->idx];
 
 			if (map_to_request(request, map, _json_map_proc_get_value, &to_eval) < 0) {
 				rcode = RLM_MODULE_FAIL;
@@ -319,6 +446,7 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, REQUEST
 				goto finish;
 			}
 			to_eval.jpath = node;
+			to_eval.start = NULL;
 
 			if (map_to_request(request, map, _json_map_proc_get_value, &to_eval) < 0) {
 				talloc_free(node);
@@ -334,9 +462,7 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, REQUEST
 
 
 finish:
-	talloc_free(json_str);
-	json_object_put(to_eval.root);
-	json_tokener_free(tok);
+	talloc_free(starts);
 
 	return rcode;
 }
@@ -347,7 +473,7 @@ static int mod_bootstrap(void *instance, UNUSED CONF_SECTION *conf)
 	xlat_register(instance, "jpathvalidate", jpath_validate_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 
 	if (map_proc_register(instance, "json", mod_map_proc,
-			      mod_map_proc_instantiate, sizeof(rlm_json_jpath_cache_t)) < 0) return -1;
+			      mod_map_proc_instantiate, sizeof(rlm_json_map_inst_t)) < 0) return -1;
 	return 0;
 }
 
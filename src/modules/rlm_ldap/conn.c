@@ -148,3 +148,661 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *tim
 
 	return conn;
 }
+
+/** A search or bind issued on one of a thread's asynchronous connections
+ *
+ */
+struct rlm_ldap_query {
+	rlm_ldap_thread_t	*thread;	//!< Thread the query was issued from.
+	rlm_ldap_async_conn_t	*aconn;		//!< Connection the query was sent on, NULL if it's queued.
+	REQUEST			*request;	//!< The query was issued for.
+
+	bool			is_bind;	//!< Whether this is a bind (or a search).
+	bool			retried;	//!< Search has been resent after the server
+						//!< rejected concurrent operations.
+	int			msgid;		//!< Assigned by libldap when the query is sent.
+	char const		*dn;		//!< Bind DN, or search base.
+	char const		*password;	//!< Bind password.
+
+	int			scope;		//!< Of the search.
+	char const		*filter;	//!< Of the search.
+	char const * const	*attrs;		//!< To retrieve.
+	LDAPControl		**serverctrls;	//!< To send with the search.
+
+	fr_event_timer_t const	*ev;		//!< Result timeout.
+	fr_dlist_t		entry;		//!< Entry in the bind or search queue.
+
+	rlm_ldap_query_cb_t	callback;	//!< Called when the query completes, NULL if cancelled.
+	void			*uctx;		//!< Passed to the callback.
+};
+
+static int ldap_async_bind_send(rlm_ldap_query_t *query);
+static int ldap_async_search_send(rlm_ldap_query_t *query, rlm_ldap_async_conn_t *aconn);
+
+static int ldap_async_query_cmp(void const *a, void const *b)
+{
+	rlm_ldap_query_t const *my_a = a, *my_b = b;
+
+	return (my_a->msgid > my_b->msgid) - (my_a->msgid < my_b->msgid);
+}
+
+static int _ldap_async_query_free(rlm_ldap_query_t *query)
+{
+	if (!query->aconn) {
+		fr_dlist_remove(&query->entry);
+		return 0;
+	}
+
+	rbtree_deletebydata(query->aconn->queries, query);
+
+	return 0;
+}
+
+/** Pass the result of a query to the caller, and free it
+ *
+ */
+static void ldap_async_query_complete(rlm_ldap_query_t *query, fr_ldap_conn_t *conn,
+				      fr_ldap_rcode_t status, LDAPMessage *result)
+{
+	rlm_ldap_query_cb_t	callback = query->callback;
+	REQUEST			*request = query->request;
+	void			*uctx = query->uctx;
+
+	talloc_free(query);
+
+	if (!callback) {
+		if (result) ldap_msgfree(result);
+		return;
+	}
+
+	callback(request, conn, status, result, uctx);
+}
+
+/** Send the next queued bind, if the bind connection is idle
+ *
+ */
+static void ldap_async_bind_next(rlm_ldap_thread_t *t)
+{
+	fr_dlist_t *entry;
+
+	while ((rbtree_num_elements(t->bind.queries) == 0) && (entry = FR_DLIST_FIRST(t->bind_queue))) {
+		rlm_ldap_query_t *query = fr_ptr_to_type(rlm_ldap_query_t, entry, entry);
+
+		fr_dlist_remove(&query->entry);
+		if (ldap_async_bind_send(query) < 0) ldap_async_query_complete(query, NULL, LDAP_PROC_ERROR, NULL);
+	}
+}
+
+/** Find the search connection with the fewest outstanding searches
+ *
+ * @return
+ *	- A connection with a free slot.  May not be connected yet.
+ *	- NULL if every connection has reached its limit.
+ */
+static rlm_ldap_async_conn_t *ldap_async_search_conn(rlm_ldap_thread_t *t)
+{
+	rlm_ldap_async_conn_t	*found = NULL;
+	uint32_t		i, outstanding, found_outstanding = 0;
+
+	for (i = 0; i < t->num_search; i++) {
+		outstanding = rbtree_num_elements(t->search[i].queries);
+		if (outstanding >= t->search[i].max_outstanding) continue;
+
+		if (!found || (outstanding < found_outstanding)) {
+			found = &t->search[i];
+			found_outstanding = outstanding;
+		}
+	}
+
+	return found;
+}
+
+/** Send queued searches, while there are connections with free slots
+ *
+ */
+static void ldap_async_search_next(rlm_ldap_thread_t *t)
+{
+	fr_dlist_t		*entry;
+	rlm_ldap_async_conn_t	*aconn;
+
+	while ((entry = FR_DLIST_FIRST(t->search_queue)) && (aconn = ldap_async_search_conn(t))) {
+		rlm_ldap_query_t *query = fr_ptr_to_type(rlm_ldap_query_t, entry, entry);
+
+		fr_dlist_remove(&query->entry);
+		if (ldap_async_search_send(query, aconn) < 0) ldap_async_query_complete(query, NULL, LDAP_PROC_ERROR, NULL);
+	}
+}
+
+/** Send whatever is waiting for a connection which may now have free slots
+ *
+ */
+static inline void ldap_async_next(rlm_ldap_async_conn_t *aconn)
+{
+	rlm_ldap_thread_t *t = aconn->thread;
+
+	if (aconn == &t->bind) {
+		ldap_async_bind_next(t);
+		return;
+	}
+
+	ldap_async_search_next(t);
+}
+
+/** Whether the server refused a search because other operations were outstanding
+ *
+ * Some servers and proxies only process one operation at a time per connection,
+ * and reply with busy or unwilling to perform, instead of queueing.
+ */
+static bool ldap_async_concurrency_rejected(fr_ldap_conn_t *conn, LDAPMessage *msg)
+{
+	int code = LDAP_SUCCESS;
+
+	if (ldap_msgtype(msg) != LDAP_RES_SEARCH_RESULT) return false;
+	if (ldap_parse_result(conn->handle, msg, &code, NULL, NULL, NULL, NULL, 0) != LDAP_SUCCESS) return false;
+
+	return (code == LDAP_BUSY) || (code == LDAP_UNWILLING_TO_PERFORM);
+}
+
+/** Close an asynchronous connection, failing any queries sent on it
+ *
+ */
+static int _ldap_async_query_detach(void *ctx, void *data)
+{
+	fr_dlist_t		*head = ctx;
+	rlm_ldap_query_t	*query = data;
+
+	query->aconn = NULL;
+	fr_dlist_insert_tail(head, &query->entry);
+
+	return 2;	/* Delete the node and continue */
+}
+
+static void ldap_async_disconnect(rlm_ldap_async_conn_t *aconn, fr_ldap_rcode_t status)
+{
+	fr_ldap_conn_t		*conn = aconn->conn;
+	fr_dlist_t		failed, *entry;
+
+	if (!conn) return;
+
+	/*
+	 *	Callbacks may issue new queries, which
+	 *	should go out on a new connection.
+	 */
+	(void) fr_event_fd_delete(aconn->thread->el, aconn->fd);
+	aconn->conn = NULL;
+	aconn->fd = -1;
+
+	FR_DLIST_INIT(failed);
+	(void) rbtree_walk(aconn->queries, RBTREE_DELETE_ORDER, _ldap_async_query_detach, &failed);
+
+	while ((entry = FR_DLIST_FIRST(failed))) {
+		rlm_ldap_query_t *query = fr_ptr_to_type(rlm_ldap_query_t, entry, entry);
+
+		ldap_async_query_complete(query, conn, status, NULL);
+	}
+
+	talloc_free(conn);
+}
+
+/** Demultiplex results arriving on an asynchronous connection
+ *
+ */
+static void _ldap_async_read(UNUSED fr_event_list_t *el, UNUSED int sock, UNUSED int flags, void *uctx)
+{
+	rlm_ldap_async_conn_t	*aconn = uctx;
+	rlm_ldap_thread_t	*t = aconn->thread;
+	struct timeval		poll = { 0, 0 };
+
+	/*
+	 *	libldap may read more than one result from the
+	 *	socket at a time, so keep going until it has
+	 *	nothing left for us.
+	 */
+	while (aconn->conn) {
+		LDAPMessage		*result = NULL, *msg;
+		rlm_ldap_query_t	find, *query;
+		fr_ldap_rcode_t		status = LDAP_PROC_SUCCESS;
+		fr_ldap_conn_t		*conn = aconn->conn;
+		fr_ldap_handle_config_t const *handle_config = conn->config;
+
+		switch (ldap_result(conn->handle, LDAP_RES_ANY, LDAP_MSG_ALL, &poll, &result)) {
+		case 0:
+			return;
+
+		case -1:
+			PERROR("Connection failed");
+			ldap_async_disconnect(aconn, LDAP_PROC_BAD_CONN);
+			goto finish;
+
+		default:
+			break;
+		}
+
+		find.msgid = ldap_msgid(result);
+		query = rbtree_finddata(aconn->queries, &find);
+		if (!query) {
+			DEBUG3("Ignoring result for msgid %i, doesn't match any outstanding query", find.msgid);
+			ldap_msgfree(result);
+			continue;
+		}
+
+		for (msg = ldap_first_message(conn->handle, result);
+		     msg;
+		     msg = ldap_next_message(conn->handle, msg)) {
+			status = fr_ldap_error_check(NULL, conn, msg, query->dn);
+			if (status != LDAP_PROC_SUCCESS) break;
+		}
+
+		/*
+		 *	Fall back to sending one search at a time on
+		 *	this connection, and resend the search.
+		 */
+		if (msg && !query->is_bind && !query->retried &&
+		    ((status == LDAP_PROC_BAD_CONN) || (status == LDAP_PROC_NOT_PERMITTED)) &&
+		    (aconn->max_outstanding > 1) && (rbtree_num_elements(aconn->queries) > 1) &&
+		    ldap_async_concurrency_rejected(conn, msg)) {
+			WARN("Server rejected concurrent searches, sending one at a time on this connection");
+			aconn->max_outstanding = 1;
+			ldap_msgfree(result);
+
+			rbtree_deletebydata(aconn->queries, query);
+			query->aconn = NULL;
+			query->retried = true;
+			fr_event_timer_delete(t->el, &query->ev);
+			fr_dlist_insert_head(&t->search_queue, &query->entry);
+			continue;
+		}
+
+		if ((status == LDAP_PROC_SUCCESS) && !query->is_bind) {
+			int count;
+
+			count = ldap_count_entries(conn->handle, result);
+			if (count < 0) {
+				status = LDAP_PROC_ERROR;
+			} else if (count == 0) {
+				status = LDAP_PROC_NO_RESULT;
+			}
+		}
+
+		if ((status != LDAP_PROC_SUCCESS) || query->is_bind) {
+			ldap_msgfree(result);
+			result = NULL;
+		}
+
+		ldap_async_query_complete(query, conn, status, result);
+
+		if (status == LDAP_PROC_BAD_CONN) {
+			ldap_async_disconnect(aconn, LDAP_PROC_BAD_CONN);
+			break;
+		}
+	}
+
+finish:
+	ldap_async_next(aconn);
+}
+
+static void _ldap_async_error(UNUSED fr_event_list_t *el, UNUSED int sock, UNUSED int flags,
+			      int fd_errno, void *uctx)
+{
+	rlm_ldap_async_conn_t	*aconn = uctx;
+	rlm_ldap_thread_t	*t = aconn->thread;
+	fr_ldap_handle_config_t const *handle_config = &t->inst->handle_config;
+
+	ERROR("Connection failed: %s", fr_syserror(fd_errno));
+
+	ldap_async_disconnect(aconn, LDAP_PROC_BAD_CONN);
+	ldap_async_next(aconn);
+}
+
+/** A query didn't complete in time
+ *
+ */
+static void _ldap_async_timeout(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	rlm_ldap_query_t	*query = uctx;
+	rlm_ldap_async_conn_t	*aconn = query->aconn;
+	fr_ldap_conn_t		*conn = aconn->conn;
+	bool			is_bind = query->is_bind;
+
+	query->ev = NULL;
+
+	fr_strerror_printf("timeout waiting for result");
+	if (!is_bind) ldap_abandon_ext(conn->handle, query->msgid, NULL, NULL);
+	ldap_async_query_complete(query, conn, LDAP_PROC_TIMEOUT, NULL);
+
+	/*
+	 *	Binds can't be abandoned, and we don't know
+	 *	what identity the connection has, so start
+	 *	again with a new one.
+	 */
+	if (is_bind) ldap_async_disconnect(aconn, LDAP_PROC_BAD_CONN);
+
+	ldap_async_next(aconn);
+}
+
+/** Open an asynchronous connection if it isn't already open
+ *
+ * @note Connecting, and the initial bind as the admin user, are synchronous.
+ */
+static int ldap_async_connect(rlm_ldap_async_conn_t *aconn)
+{
+	rlm_ldap_thread_t		*t = aconn->thread;
+	fr_ldap_handle_config_t const	*handle_config = &t->inst->handle_config;
+	fr_ldap_conn_t			*conn;
+	void				*instance;
+
+	if (aconn->conn) return 0;
+
+	memcpy(&instance, &handle_config, sizeof(instance));	/* const issues */
+	conn = mod_conn_create(NULL, instance, &handle_config->net_timeout);
+	if (!conn) return -1;
+
+	if ((ldap_get_option(conn->handle, LDAP_OPT_DESC, &aconn->fd) != LDAP_OPT_SUCCESS) || (aconn->fd < 0)) {
+		ERROR("Failed retrieving connection fd");
+	error:
+		talloc_free(conn);
+		aconn->fd = -1;
+		return -1;
+	}
+
+	if (fr_event_fd_insert(conn, t->el, aconn->fd, _ldap_async_read, NULL, _ldap_async_error, aconn) < 0) {
+		PERROR("Failed inserting connection fd into event list");
+		goto error;
+	}
+	aconn->conn = conn;
+
+	/*
+	 *	A new connection may be to a server which
+	 *	does handle concurrent searches.
+	 */
+	if (aconn != &t->bind) aconn->max_outstanding = t->inst->async_max_outstanding;
+
+	return 0;
+}
+
+/** Start the result timer, and record the query against its connection
+ *
+ */
+static int ldap_async_query_sent(rlm_ldap_query_t *query, rlm_ldap_async_conn_t *aconn, int msgid)
+{
+	struct timeval when;
+
+	query->aconn = aconn;
+	query->msgid = msgid;
+
+	if (!rbtree_insert(aconn->queries, query)) {
+		query->aconn = NULL;
+		return -1;
+	}
+
+	gettimeofday(&when, NULL);
+	fr_timeval_add(&when, &when, &aconn->thread->inst->handle_config.res_timeout);
+	if (fr_event_timer_insert(query, aconn->thread->el, &query->ev, &when, _ldap_async_timeout, query) < 0) {
+		rbtree_deletebydata(aconn->queries, query);
+		query->aconn = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Send a query's bind on the bind connection
+ *
+ */
+static int ldap_async_bind_send(rlm_ldap_query_t *query)
+{
+	rlm_ldap_thread_t	*t = query->thread;
+	REQUEST			*request = query->request;
+	int			msgid;
+
+	if (ldap_async_connect(&t->bind) < 0) return -1;
+
+	if (fr_ldap_bind_async(&msgid, request, t->bind.conn, query->dn, query->password, NULL, NULL) < 0) {
+		if (fr_ldap_error_check(NULL, t->bind.conn, NULL, query->dn) == LDAP_PROC_BAD_CONN) {
+			ldap_async_disconnect(&t->bind, LDAP_PROC_BAD_CONN);
+		}
+		return -1;
+	}
+
+	return ldap_async_query_sent(query, &t->bind, msgid);
+}
+
+/** Send a search on one of the thread's search connections
+ *
+ */
+static int ldap_async_search_send(rlm_ldap_query_t *query, rlm_ldap_async_conn_t *aconn)
+{
+	REQUEST			*request = query->request;
+	fr_ldap_rcode_t		status;
+	int			msgid;
+
+	if (ldap_async_connect(aconn) < 0) return -1;
+
+#ifdef LDAP_CONTROL_X_SESSION_TRACKING
+	/*
+	 *	Controls are sent with the search, so can
+	 *	be cleared as soon as it's been sent.
+	 */
+	if (query->thread->inst->session_tracking &&
+	    (fr_ldap_control_add_session_tracking(aconn->conn, request) < 0)) return -1;
+#endif
+
+	status = fr_ldap_search_async(&msgid, request, &aconn->conn, query->dn, query->scope, query->filter,
+				      query->attrs, query->serverctrls, NULL);
+	fr_ldap_control_clear(aconn->conn);
+	if (status != LDAP_PROC_SUCCESS) {
+		if (fr_ldap_error_check(NULL, aconn->conn, NULL, query->dn) == LDAP_PROC_BAD_CONN) {
+			ldap_async_disconnect(aconn, LDAP_PROC_BAD_CONN);
+		}
+		return -1;
+	}
+
+	if (ldap_async_query_sent(query, aconn, msgid) < 0) {
+		ldap_abandon_ext(aconn->conn->handle, msgid, NULL, NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Search for something in the LDAP directory, without blocking
+ *
+ * The search is sent on whichever of the thread's search connections has the fewest
+ * outstanding searches.  If every connection has reached its limit, the search is
+ * queued until one has a free slot.
+ *
+ * @param[in] t			Thread specific connections.
+ * @param[in] request		Current request.
+ * @param[in] dn		to use as base for the search.
+ * @param[in] scope		to use (LDAP_SCOPE_BASE, LDAP_SCOPE_ONE, LDAP_SCOPE_SUB).
+ * @param[in] filter		to use, should be pre-escaped.
+ * @param[in] attrs		to retrieve.  Must remain valid until the callback is called,
+ *				or the search is cancelled.
+ * @param[in] serverctrls	Search controls to pass to the server.  May be NULL.
+ *				Must remain valid until the callback is called, or the search
+ *				is cancelled.
+ * @param[in] callback		to call when the search completes.
+ * @param[in] uctx		to pass to the callback.
+ * @return
+ *	- A handle that may be passed to #rlm_ldap_query_cancel.
+ *	- NULL if the search couldn't be sent.
+ */
+rlm_ldap_query_t *rlm_ldap_search_async(rlm_ldap_thread_t *t, REQUEST *request,
+					char const *dn, int scope, char const *filter, char const * const *attrs,
+					LDAPControl **serverctrls,
+					rlm_ldap_query_cb_t callback, void *uctx)
+{
+	fr_ldap_handle_config_t const *handle_config = &t->inst->handle_config;
+	rlm_ldap_query_t	*query;
+	rlm_ldap_async_conn_t	*aconn;
+
+	MEM(query = talloc_zero(t->search, rlm_ldap_query_t));
+	FR_DLIST_INIT(query->entry);
+	query->thread = t;
+	query->request = request;
+	query->dn = talloc_strdup(query, dn);
+	query->scope = scope;
+	if (filter) query->filter = talloc_strdup(query, filter);
+	query->attrs = attrs;
+	query->serverctrls = serverctrls;
+	query->callback = callback;
+	query->uctx = uctx;
+
+	/*
+	 *	Don't overtake searches which are already waiting.
+	 */
+	if ((FR_DLIST_FIRST(t->search_queue)) || !(aconn = ldap_async_search_conn(t))) {
+		RDEBUG2("All search connections busy, queueing search");
+		fr_dlist_insert_tail(&t->search_queue, &query->entry);
+		talloc_set_destructor(query, _ldap_async_query_free);
+		return query;
+	}
+
+	if (ldap_async_search_send(query, aconn) < 0) {
+		talloc_free(query);
+		return NULL;
+	}
+	talloc_set_destructor(query, _ldap_async_query_free);
+
+	return query;
+}
+
+/** Bind as a user, without blocking
+ *
+ * Binds are performed on the thread's bind connection.  Only one bind may be
+ * outstanding on a connection, so binds are queued until the connection is idle.
+ *
+ * @param[in] t			Thread specific connections.
+ * @param[in] request		Current request.
+ * @param[in] dn		of the user.
+ * @param[in] password		of the user.
+ * @param[in] callback		to call when the bind completes.
+ * @param[in] uctx		to pass to the callback.
+ * @return
+ *	- A handle that may be passed to #rlm_ldap_query_cancel.
+ *	- NULL if the bind couldn't be sent.
+ */
+rlm_ldap_query_t *rlm_ldap_bind_async(rlm_ldap_thread_t *t, REQUEST *request,
+				      char const *dn, char const *password,
+				      rlm_ldap_query_cb_t callback, void *uctx)
+{
+	fr_ldap_handle_config_t const *handle_config = &t->inst->handle_config;
+	rlm_ldap_query_t	*query;
+
+	MEM(query = talloc_zero(t->bind.queries, rlm_ldap_query_t));
+	FR_DLIST_INIT(query->entry);
+	query->thread = t;
+	query->request = request;
+	query->is_bind = true;
+	query->dn = talloc_strdup(query, dn);
+	query->password = talloc_strdup(query, password);
+	query->callback = callback;
+	query->uctx = uctx;
+
+	if ((rbtree_num_elements(t->bind.queries) > 0) || (FR_DLIST_FIRST(t->bind_queue))) {
+		RDEBUG2("Bind connection busy, queueing bind");
+		fr_dlist_insert_tail(&t->bind_queue, &query->entry);
+		talloc_set_destructor(query, _ldap_async_query_free);
+		return query;
+	}
+
+	if (ldap_async_bind_send(query) < 0) {
+		talloc_free(query);
+		return NULL;
+	}
+	talloc_set_destructor(query, _ldap_async_query_free);
+
+	return query;
+}
+
+/** Stop waiting for the result of a query
+ *
+ * Searches are abandoned.  Binds can't be abandoned, so their result is discarded.
+ *
+ * @param[in] query to cancel.
+ */
+void rlm_ldap_query_cancel(rlm_ldap_query_t *query)
+{
+	if (query->aconn && query->is_bind) {
+		query->callback = NULL;
+		query->request = NULL;
+		return;
+	}
+
+	if (query->aconn) {
+		rlm_ldap_thread_t *t = query->thread;
+
+		ldap_abandon_ext(query->aconn->conn->handle, query->msgid, NULL, NULL);
+		talloc_free(query);
+		ldap_async_search_next(t);
+		return;
+	}
+	talloc_free(query);
+}
+
+/** Initialise a thread's asynchronous connections
+ *
+ * Connections are opened when they're first used.
+ */
+int rlm_ldap_thread_init(rlm_ldap_thread_t *t, rlm_ldap_t const *inst, fr_event_list_t *el)
+{
+	uint32_t i;
+
+	t->inst = inst;
+	t->el = el;
+	FR_DLIST_INIT(t->bind_queue);
+	FR_DLIST_INIT(t->search_queue);
+
+	t->num_search = inst->async_connections;
+	t->search = talloc_zero_array(NULL, rlm_ldap_async_conn_t, t->num_search);
+	if (!t->search) return -1;
+
+	for (i = 0; i < t->num_search; i++) {
+		t->search[i].thread = t;
+		t->search[i].fd = -1;
+		t->search[i].max_outstanding = inst->async_max_outstanding;
+		t->search[i].queries = rbtree_create(t->search, ldap_async_query_cmp, NULL, 0);
+		if (!t->search[i].queries) return -1;
+	}
+
+	t->bind.thread = t;
+	t->bind.fd = -1;
+	t->bind.max_outstanding = 1;
+	t->bind.queries = rbtree_create(NULL, ldap_async_query_cmp, NULL, 0);
+	if (!t->bind.queries) return -1;
+
+	return 0;
+}
+
+/** Close a thread's asynchronous connections
+ *
+ */
+void rlm_ldap_thread_free(rlm_ldap_thread_t *t)
+{
+	fr_dlist_t	*entry;
+	uint32_t	i;
+
+	while ((entry = FR_DLIST_FIRST(t->bind_queue))) {
+		rlm_ldap_query_t *query = fr_ptr_to_type(rlm_ldap_query_t, entry, entry);
+
+		ldap_async_query_complete(query, NULL, LDAP_PROC_ERROR, NULL);
+	}
+
+	while ((entry = FR_DLIST_FIRST(t->search_queue))) {
+		rlm_ldap_query_t *query = fr_ptr_to_type(rlm_ldap_query_t, entry, entry);
+
+		ldap_async_query_complete(query, NULL, LDAP_PROC_ERROR, NULL);
+	}
+
+	/*
+	 *	Stop callbacks from queueing new searches
+	 *	behind us.
+	 */
+	for (i = 0; i < t->num_search; i++) t->search[i].max_outstanding = 0;
+
+	for (i = 0; i < t->num_search; i++) ldap_async_disconnect(&t->search[i], LDAP_PROC_ERROR);
+	ldap_async_disconnect(&t->bind, LDAP_PROC_ERROR);
+
+	TALLOC_FREE(t->search);
+	TALLOC_FREE(t->bind.queries);
+}
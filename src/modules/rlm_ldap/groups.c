@@ -841,3 +841,238 @@ rlm_rcode_t rlm_ldap_check_cached(rlm_ldap_t const *inst, REQUEST *request, VALU
 	RDEBUG2("Cached membership not found");
 	return RLM_MODULE_NOTFOUND;
 }
+
+/** Number of independently locked trees in the membership cache
+ *
+ * Workers looking up different users rarely contend for the same lock.
+ */
+#define LDAP_MEMBERSHIP_CACHE_SHARDS	16
+
+/** Cached group memberships for a single user object
+ *
+ */
+typedef struct ldap_membership {
+	char const	*dn;			//!< Of the user object.  The key.
+	time_t		expires;		//!< When the entry must no longer be used.
+	char		**groups;		//!< Values of the cache attribute (group names and/or DNs).
+} ldap_membership_t;
+
+typedef struct ldap_membership_shard {
+	pthread_mutex_t	mutex;
+	rbtree_t	*tree;
+} ldap_membership_shard_t;
+
+struct rlm_ldap_membership_cache {
+	uint32_t		max_per_shard;	//!< Maximum number of entries in each shard.
+	ldap_membership_shard_t	shard[LDAP_MEMBERSHIP_CACHE_SHARDS];
+};
+
+static int ldap_membership_cmp(void const *one, void const *two)
+{
+	ldap_membership_t const *a = one, *b = two;
+
+	return strcmp(a->dn, b->dn);
+}
+
+static int _ldap_membership_expire(void *ctx, void *data)
+{
+	time_t			*now = ctx;
+	ldap_membership_t	*entry = data;
+
+	return (entry->expires <= *now) ? 2 : 0;
+}
+
+static int _ldap_membership_cache_free(rlm_ldap_membership_cache_t *cache)
+{
+	int i;
+
+	for (i = 0; i < LDAP_MEMBERSHIP_CACHE_SHARDS; i++) {
+		talloc_free(cache->shard[i].tree);
+		pthread_mutex_destroy(&cache->shard[i].mutex);
+	}
+
+	return 0;
+}
+
+/** Allocate a cache of group memberships, shared by all workers
+ *
+ * @param[in] ctx	to allocate the cache in.
+ * @param[in] max	Total number of user objects to cache memberships for.
+ * @return The new cache.
+ */
+rlm_ldap_membership_cache_t *rlm_ldap_membership_cache_alloc(TALLOC_CTX *ctx, uint32_t max)
+{
+	rlm_ldap_membership_cache_t	*cache;
+	int				i;
+
+	cache = talloc_zero(ctx, rlm_ldap_membership_cache_t);
+	if (!cache) return NULL;
+	cache->max_per_shard = (max / LDAP_MEMBERSHIP_CACHE_SHARDS) + 1;
+
+	for (i = 0; i < LDAP_MEMBERSHIP_CACHE_SHARDS; i++) {
+		pthread_mutex_init(&cache->shard[i].mutex, NULL);
+		cache->shard[i].tree = rbtree_create(cache, ldap_membership_cmp, rbtree_node_talloc_free,
+						     RBTREE_FLAG_REPLACE);
+		if (!cache->shard[i].tree) {
+			talloc_free(cache);
+			return NULL;
+		}
+	}
+	talloc_set_destructor(cache, _ldap_membership_cache_free);
+
+	return cache;
+}
+
+static inline ldap_membership_shard_t *ldap_membership_shard(rlm_ldap_membership_cache_t *cache, char const *dn)
+{
+	return &cache->shard[fr_hash_string(dn) % LDAP_MEMBERSHIP_CACHE_SHARDS];
+}
+
+/** Copy cached memberships into the control list
+ *
+ * @return
+ *	- true if an unexpired entry was found.
+ *	- false otherwise.
+ */
+static bool ldap_membership_cache_find(rlm_ldap_t const *inst, REQUEST *request, char const *dn)
+{
+	ldap_membership_shard_t	*shard = ldap_membership_shard(inst->membership_cache, dn);
+	ldap_membership_t	find, *entry;
+	VALUE_PAIR		*vp;
+	time_t			now = time(NULL);
+	size_t			i;
+
+	find.dn = dn;
+
+	pthread_mutex_lock(&shard->mutex);
+	entry = rbtree_finddata(shard->tree, &find);
+	if (!entry) {
+		pthread_mutex_unlock(&shard->mutex);
+		return false;
+	}
+
+	if (entry->expires <= now) {
+		rbtree_deletebydata(shard->tree, entry);
+		pthread_mutex_unlock(&shard->mutex);
+		return false;
+	}
+
+	RDEBUG("Adding memberships cached for \"%s\" (expires in %u seconds)", dn, (unsigned int)(entry->expires - now));
+	RINDENT();
+	for (i = 0; i < talloc_array_length(entry->groups); i++) {
+		MEM(vp = pair_make_config(inst->cache_da->name, NULL, T_OP_ADD));
+		fr_pair_value_strcpy(vp, entry->groups[i]);
+		RDEBUG("&control:%s += \"%s\"", inst->cache_da->name, vp->vp_strvalue);
+	}
+	REXDENT();
+	pthread_mutex_unlock(&shard->mutex);
+
+	return true;
+}
+
+/** Record the memberships in the control list against the user object
+ *
+ */
+static void ldap_membership_cache_store(rlm_ldap_t const *inst, REQUEST *request, char const *dn)
+{
+	ldap_membership_shard_t	*shard = ldap_membership_shard(inst->membership_cache, dn);
+	ldap_membership_t	*entry;
+	VALUE_PAIR		*vp;
+	vp_cursor_t		cursor;
+	time_t			now = time(NULL);
+	size_t			count = 0;
+
+	MEM(entry = talloc_zero(NULL, ldap_membership_t));
+	entry->dn = talloc_strdup(entry, dn);
+	entry->expires = now + inst->membership_cache_ttl;
+
+	fr_pair_cursor_init(&cursor, &request->control);
+	while (fr_pair_cursor_next_by_num(&cursor, inst->cache_da->vendor, inst->cache_da->attr, TAG_ANY)) count++;
+
+	MEM(entry->groups = talloc_array(entry, char *, count));
+	count = 0;
+	fr_pair_cursor_first(&cursor);
+	while ((vp = fr_pair_cursor_next_by_num(&cursor, inst->cache_da->vendor, inst->cache_da->attr, TAG_ANY))) {
+		entry->groups[count++] = talloc_strdup(entry->groups, vp->vp_strvalue);
+	}
+
+	pthread_mutex_lock(&shard->mutex);
+	if (rbtree_num_elements(shard->tree) >= inst->membership_cache->max_per_shard) {
+		rbtree_walk(shard->tree, RBTREE_DELETE_ORDER, _ldap_membership_expire, &now);
+
+		if (rbtree_num_elements(shard->tree) >= inst->membership_cache->max_per_shard) {
+			pthread_mutex_unlock(&shard->mutex);
+			RDEBUG2("Membership cache is full, not caching memberships");
+			talloc_free(entry);
+			return;
+		}
+	}
+
+	if (!rbtree_insert(shard->tree, entry)) {
+		pthread_mutex_unlock(&shard->mutex);
+		talloc_free(entry);
+		return;
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	RDEBUG2("Cached %zu membership(s) for \"%s\"", count, dn);
+}
+
+/** Determine all of a user's group memberships, using the membership cache if possible
+ *
+ * On success the memberships are written to the control list, as with #rlm_ldap_cacheable_userobj
+ * and #rlm_ldap_cacheable_groupobj, so subsequent comparisons for the same request don't need to
+ * consult the cache or the directory.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
+ * @param[in] dn of the user object.
+ * @param[in] entry the user object, if the caller has already retrieved it.  Must include the
+ *	membership attribute.  If NULL, and a membership attribute is configured, the user object
+ *	is retrieved.
+ * @return One of the RLM_MODULE_* values.
+ */
+rlm_rcode_t rlm_ldap_membership_lookup(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_conn_t **pconn,
+				       char const *dn, LDAPMessage *entry)
+{
+	rlm_rcode_t	rcode = RLM_MODULE_OK;
+	LDAPMessage	*result = NULL;
+
+	rad_assert(inst->membership_cache);
+
+	if (ldap_membership_cache_find(inst, request, dn)) return RLM_MODULE_OK;
+
+	if (inst->userobj_membership_attr) {
+		if (!entry) {
+			char const	*attrs[] = { inst->userobj_membership_attr, NULL };
+			fr_ldap_rcode_t	status;
+
+			status = fr_ldap_search(&result, request, pconn, dn, LDAP_SCOPE_BASE, NULL, attrs, NULL, NULL);
+			switch (status) {
+			case LDAP_PROC_SUCCESS:
+				entry = ldap_first_entry((*pconn)->handle, result);
+				break;
+
+			case LDAP_PROC_BAD_DN:
+			case LDAP_PROC_NO_RESULT:
+				break;
+
+			default:
+				return RLM_MODULE_FAIL;
+			}
+		}
+
+		if (entry) rcode = rlm_ldap_cacheable_userobj(inst, request, pconn, entry,
+							      inst->userobj_membership_attr);
+		if (result) ldap_msgfree(result);
+		if (rcode != RLM_MODULE_OK) return rcode;
+	}
+
+	rcode = rlm_ldap_cacheable_groupobj(inst, request, pconn);
+	if (rcode != RLM_MODULE_OK) return rcode;
+
+	ldap_membership_cache_store(inst, request, dn);
+
+	return RLM_MODULE_OK;
+}
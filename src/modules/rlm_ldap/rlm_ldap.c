@@ -113,6 +113,8 @@ static CONF_PARSER group_config[] = {
 	{ FR_CONF_OFFSET("cacheable_name", FR_TYPE_BOOL, rlm_ldap_t, cacheable_group_name), .dflt = "no" },
 	{ FR_CONF_OFFSET("cacheable_dn", FR_TYPE_BOOL, rlm_ldap_t, cacheable_group_dn), .dflt = "no" },
 	{ FR_CONF_OFFSET("cache_attribute", FR_TYPE_STRING, rlm_ldap_t, cache_attribute) },
+	{ FR_CONF_OFFSET("membership_cache_ttl", FR_TYPE_UINT32, rlm_ldap_t, membership_cache_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("membership_cache_max", FR_TYPE_UINT32, rlm_ldap_t, membership_cache_max), .dflt = "4096" },
 	{ FR_CONF_OFFSET("group_attribute", FR_TYPE_STRING, rlm_ldap_t, group_attribute) },
 	CONF_PARSER_TERMINATOR
 };
@@ -173,6 +175,10 @@ static CONF_PARSER option_config[] = {
 	/* timeout for search results */
 	{ FR_CONF_OFFSET("res_timeout", FR_TYPE_TIMEVAL, rlm_ldap_t, handle_config.res_timeout), .dflt = "20" },
 
+	{ FR_CONF_OFFSET("async_connections", FR_TYPE_UINT32, rlm_ldap_t, async_connections), .dflt = "2" },
+
+	{ FR_CONF_OFFSET("async_max_outstanding", FR_TYPE_UINT32, rlm_ldap_t, async_max_outstanding), .dflt = "32" },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -610,6 +616,18 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 	rad_assert(conn);
 
+	/*
+	 *	Retrieve all of the user's memberships at once, so
+	 *	that this, and later comparisons, don't need to go
+	 *	back to the directory.
+	 */
+	if (inst->membership_cache &&
+	    ((check_is_dn && inst->cacheable_group_dn) || (!check_is_dn && inst->cacheable_group_name)) &&
+	    (rlm_ldap_membership_lookup(inst, request, &conn, user_dn, NULL) == RLM_MODULE_OK)) {
+		found = (rlm_ldap_check_cached(inst, request, check) == RLM_MODULE_OK);
+		goto finish;
+	}
+
 	/*
 	 *	Check groupobj user membership
 	 */
@@ -658,8 +676,143 @@ finish:
 	return 0;
 }
 
-static rlm_rcode_t mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
+/** Convert the result of a user bind to a module rcode
+ *
+ */
+static rlm_rcode_t ldap_bind_rcode(REQUEST *request, fr_ldap_rcode_t status, char const *dn)
+{
+	switch (status) {
+	case LDAP_PROC_SUCCESS:
+		RDEBUG("Bind as user \"%s\" was successful", dn);
+		return RLM_MODULE_OK;
+
+	case LDAP_PROC_NOT_PERMITTED:
+		return RLM_MODULE_USERLOCK;
+
+	case LDAP_PROC_REJECT:
+		return RLM_MODULE_REJECT;
+
+	case LDAP_PROC_BAD_DN:
+		return RLM_MODULE_INVALID;
+
+	case LDAP_PROC_NO_RESULT:
+		return RLM_MODULE_NOTFOUND;
+
+	default:
+		return RLM_MODULE_FAIL;
+	}
+}
+
+/** State for an authenticate call that's waiting for a search or bind
+ *
+ */
+typedef struct ldap_auth_ctx {
+	rlm_ldap_t const	*inst;
+	rlm_ldap_thread_t	*thread;
+	rlm_ldap_query_t	*query;		//!< Search or bind in progress.
+	char const		*dn;		//!< We're binding as.
+	rlm_rcode_t		rcode;		//!< Result of the search or bind.
+} ldap_auth_ctx_t;
+
+static void _ldap_auth_bound(REQUEST *request, UNUSED fr_ldap_conn_t *conn, fr_ldap_rcode_t status,
+			     LDAPMessage *result, void *uctx)
+{
+	ldap_auth_ctx_t	*auth = uctx;
+
+	if (result) ldap_msgfree(result);
+
+	auth->query = NULL;
+	auth->rcode = ldap_bind_rcode(request, status, auth->dn);
+
+	unlang_resumable(request);
+}
+
+static int ldap_auth_bind(ldap_auth_ctx_t *auth, REQUEST *request)
+{
+	auth->query = rlm_ldap_bind_async(auth->thread, request, auth->dn, request->password->vp_strvalue,
+					  _ldap_auth_bound, auth);
+	if (!auth->query) return -1;
+
+	return 0;
+}
+
+static void _ldap_auth_user_found(REQUEST *request, fr_ldap_conn_t *conn, fr_ldap_rcode_t status,
+				  LDAPMessage *result, void *uctx)
+{
+	ldap_auth_ctx_t	*auth = uctx;
+
+	auth->query = NULL;
+	auth->dn = rlm_ldap_find_user_result(auth->inst, request, conn, status, result, &auth->rcode);
+	if (result) ldap_msgfree(result);
+
+	if (auth->dn && (ldap_auth_bind(auth, request) < 0)) auth->rcode = RLM_MODULE_FAIL;
+
+	/*
+	 *	Either waiting for the bind, or finished
+	 */
+	if (!auth->query) unlang_resumable(request);
+}
+
+static rlm_rcode_t mod_authenticate_resume(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+					   void *ctx)
+{
+	ldap_auth_ctx_t	*auth = ctx;
+	rlm_rcode_t	rcode = auth->rcode;
+
+	talloc_free(auth);
+
+	return rcode;
+}
+
+static void mod_authenticate_signal(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+				    void *ctx, fr_state_action_t action)
+{
+	ldap_auth_ctx_t	*auth = ctx;
+
+	if (action != FR_ACTION_DONE) return;
+
+	if (auth->query) {
+		rlm_ldap_query_cancel(auth->query);
+		auth->query = NULL;
+	}
+}
+
+/** Authenticate a user with a simple bind, without blocking the worker
+ *
+ */
+static rlm_rcode_t ldap_authenticate_async(rlm_ldap_t const *inst, rlm_ldap_thread_t *thread, REQUEST *request)
+{
+	ldap_auth_ctx_t	*auth;
+	VALUE_PAIR	*vp;
+	rlm_rcode_t	rcode;
+
+	MEM(auth = talloc_zero(request, ldap_auth_ctx_t));
+	auth->inst = inst;
+	auth->thread = thread;
+
+	/*
+	 *	We already know the DN, skip straight to the bind.
+	 */
+	vp = fr_pair_find_by_num(request->control, 0, FR_LDAP_USERDN, TAG_ANY);
+	if (vp) {
+		auth->dn = vp->vp_strvalue;
+		if (ldap_auth_bind(auth, request) < 0) {
+			talloc_free(auth);
+			return RLM_MODULE_FAIL;
+		}
+	} else {
+		rcode = rlm_ldap_find_user_async(inst, thread, request, NULL, _ldap_auth_user_found, auth, &auth->query);
+		if (rcode != RLM_MODULE_OK) {
+			talloc_free(auth);
+			return rcode;
+		}
+	}
+
+	return unlang_module_yield(request, mod_authenticate_resume, mod_authenticate_signal, auth);
+}
+
+static rlm_rcode_t mod_authenticate(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, void *thread, REQUEST *request)
 {
 	rlm_rcode_t		rcode;
 	fr_ldap_rcode_t		status;
@@ -702,6 +855,16 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 		return RLM_MODULE_INVALID;
 	}
 
+	/*
+	 *	SASL binds may need several round trips,
+	 *	so they're still performed synchronously.
+	 */
+	if (!inst->user_sasl.mech) {
+		RDEBUG("Login attempt by \"%s\"", request->username->vp_strvalue);
+
+		return ldap_authenticate_async(inst, thread, request);
+	}
+
 	conn = mod_conn_get(inst, request);
 	if (!conn) return RLM_MODULE_FAIL;
 
@@ -755,32 +918,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 			      inst->user_sasl.mech ? &sasl : NULL,
 			      NULL,
 			      NULL, NULL);
-	switch (status) {
-	case LDAP_PROC_SUCCESS:
-		rcode = RLM_MODULE_OK;
-		RDEBUG("Bind as user \"%s\" was successful", dn);
-		break;
-
-	case LDAP_PROC_NOT_PERMITTED:
-		rcode = RLM_MODULE_USERLOCK;
-		break;
-
-	case LDAP_PROC_REJECT:
-		rcode = RLM_MODULE_REJECT;
-		break;
-
-	case LDAP_PROC_BAD_DN:
-		rcode = RLM_MODULE_INVALID;
-		break;
-
-	case LDAP_PROC_NO_RESULT:
-		rcode = RLM_MODULE_NOTFOUND;
-		break;
-
-	default:
-		rcode = RLM_MODULE_FAIL;
-		break;
-	};
+	rcode = ldap_bind_rcode(request, status, dn);
 
 finish:
 	mod_conn_release(inst, request, conn);
@@ -862,59 +1000,84 @@ free_result:
 	return rcode;
 }
 
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+/** State for an authorize call that's waiting for the user object
+ *
+ */
+typedef struct ldap_autz_ctx {
+	rlm_ldap_t const	*inst;
+	rlm_ldap_query_t	*query;		//!< Search in progress, NULL once the result is received.
+	fr_ldap_map_exp_t	expanded;	//!< Attributes we're retrieving.
+	LDAPMessage		*result;	//!< User object.
+	char const		*dn;		//!< Of the user object.
+	rlm_rcode_t		rcode;		//!< Result of the search.
+} ldap_autz_ctx_t;
+
+static int _ldap_autz_ctx_free(ldap_autz_ctx_t *autz)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_OK;
-	fr_ldap_rcode_t		status;
-	int			ldap_errno;
-	int			i;
-	rlm_ldap_t const	*inst = instance;
-	struct berval		**values;
-	VALUE_PAIR		*vp;
-	fr_ldap_conn_t		*conn;
-	LDAPMessage		*result, *entry;
-	char const 		*dn = NULL;
-	fr_ldap_map_exp_t	expanded; /* faster than allocing every time */
-
-	/*
-	 *	Don't be tempted to add a check for request->username
-	 *	or request->password here. rlm_ldap.authorize can be used for
-	 *	many things besides searching for users.
-	 */
+	if (autz->query) rlm_ldap_query_cancel(autz->query);
+	if (autz->result) ldap_msgfree(autz->result);
+	talloc_free(autz->expanded.ctx);
 
-	if (fr_ldap_map_expand(&expanded, request, inst->user_map) < 0) return RLM_MODULE_FAIL;
+	return 0;
+}
 
-	conn = mod_conn_get(inst, request);
-	if (!conn) return RLM_MODULE_FAIL;
+static void _ldap_autz_user_found(REQUEST *request, fr_ldap_conn_t *conn, fr_ldap_rcode_t status,
+				  LDAPMessage *result, void *uctx)
+{
+	ldap_autz_ctx_t		*autz = uctx;
 
-	/*
-	 *	Add any additional attributes we need for checking access, memberships, and profiles
-	 */
-	if (inst->userobj_access_attr) {
-		expanded.attrs[expanded.count++] = inst->userobj_access_attr;
+	autz->query = NULL;
+	autz->dn = rlm_ldap_find_user_result(autz->inst, request, conn, status, result, &autz->rcode);
+	if (autz->dn) {
+		autz->result = result;
+	} else if (result) {
+		ldap_msgfree(result);
 	}
 
-	if (inst->userobj_membership_attr && (inst->cacheable_group_dn || inst->cacheable_group_name)) {
-		expanded.attrs[expanded.count++] = inst->userobj_membership_attr;
-	}
+	unlang_resumable(request);
+}
 
-	if (inst->profile_attr) {
-		expanded.attrs[expanded.count++] = inst->profile_attr;
-	}
+static void mod_authorize_signal(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+				 void *ctx, fr_state_action_t action)
+{
+	ldap_autz_ctx_t	*autz = ctx;
 
-	if (inst->valuepair_attr) {
-		expanded.attrs[expanded.count++] = inst->valuepair_attr;
+	if (action != FR_ACTION_DONE) return;
+
+	if (autz->query) {
+		rlm_ldap_query_cancel(autz->query);
+		autz->query = NULL;
 	}
+}
 
-	expanded.attrs[expanded.count] = NULL;
+/** Apply the user object, and any profiles and group memberships
+ *
+ * Further searches are performed synchronously, using a pooled connection.
+ */
+static rlm_rcode_t mod_authorize_resume(REQUEST *request, void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_rcode_t		rcode;
+	fr_ldap_rcode_t		status;
+	int			ldap_errno;
+	int			i;
+	rlm_ldap_t const	*inst = instance;
+	ldap_autz_ctx_t		*autz = ctx;
+	struct berval		**values;
+	VALUE_PAIR		*vp;
+	fr_ldap_conn_t		*conn = NULL;
+	LDAPMessage		*entry;
+	char const 		*dn = autz->dn;
 
-	dn = rlm_ldap_find_user(inst, request, &conn, expanded.attrs, true, &result, &rcode);
-	if (!dn) {
+	rcode = autz->rcode;
+	if (!dn) goto finish;
+
+	conn = mod_conn_get(inst, request);
+	if (!conn) {
+		rcode = RLM_MODULE_FAIL;
 		goto finish;
 	}
 
-	entry = ldap_first_entry(conn->handle, result);
+	entry = ldap_first_entry(conn->handle, autz->result);
 	if (!entry) {
 		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
@@ -935,7 +1098,12 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 	/*
 	 *	Check if we need to cache group memberships
 	 */
-	if (inst->cacheable_group_dn || inst->cacheable_group_name) {
+	if (inst->membership_cache) {
+		rcode = rlm_ldap_membership_lookup(inst, request, &conn, dn, entry);
+		if (rcode != RLM_MODULE_OK) {
+			goto finish;
+		}
+	} else if (inst->cacheable_group_dn || inst->cacheable_group_name) {
 		if (inst->userobj_membership_attr) {
 			rcode = rlm_ldap_cacheable_userobj(inst, request, &conn, entry, inst->userobj_membership_attr);
 			if (rcode != RLM_MODULE_OK) {
@@ -1042,7 +1210,7 @@ skip_edir:
 			goto finish;
 		}
 
-		switch (rlm_ldap_map_profile(inst, request, &conn, profile, &expanded)) {
+		switch (rlm_ldap_map_profile(inst, request, &conn, profile, &autz->expanded)) {
 		case RLM_MODULE_INVALID:
 			rcode = RLM_MODULE_INVALID;
 			goto finish;
@@ -1070,7 +1238,7 @@ skip_edir:
 				char *value;
 
 				value = fr_ldap_berval_to_string(request, values[i]);
-				ret = rlm_ldap_map_profile(inst, request, &conn, value, &expanded);
+				ret = rlm_ldap_map_profile(inst, request, &conn, value, &autz->expanded);
 				talloc_free(value);
 				if (ret == RLM_MODULE_FAIL) {
 					ldap_value_free_len(values);
@@ -1087,19 +1255,78 @@ skip_edir:
 		RDEBUG("Processing user attributes");
 		RINDENT();
 		if (fr_ldap_map_do(request, conn, inst->valuepair_attr,
-				   &expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
+				   &autz->expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
 		REXDENT();
 		rlm_ldap_check_reply(inst, request, conn);
 	}
 
 finish:
-	talloc_free(expanded.ctx);
-	if (result) ldap_msgfree(result);
+	talloc_free(autz);
 	mod_conn_release(inst, request, conn);
 
 	return rcode;
 }
 
+
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request)
+{
+	rlm_rcode_t		rcode;
+	rlm_ldap_t const	*inst = instance;
+	ldap_autz_ctx_t		*autz;
+	fr_ldap_map_exp_t	*expanded;
+
+	/*
+	 *	Don't be tempted to add a check for request->username
+	 *	or request->password here. rlm_ldap.authorize can be used for
+	 *	many things besides searching for users.
+	 */
+
+	MEM(autz = talloc_zero(request, ldap_autz_ctx_t));
+	autz->inst = inst;
+	expanded = &autz->expanded;
+
+	if (fr_ldap_map_expand(expanded, request, inst->user_map) < 0) {
+		talloc_free(autz);
+		return RLM_MODULE_FAIL;
+	}
+	talloc_set_destructor(autz, _ldap_autz_ctx_free);
+
+	/*
+	 *	Add any additional attributes we need for checking access, memberships, and profiles
+	 */
+	if (inst->userobj_access_attr) {
+		expanded->attrs[expanded->count++] = inst->userobj_access_attr;
+	}
+
+	if (inst->userobj_membership_attr && (inst->cacheable_group_dn || inst->cacheable_group_name)) {
+		expanded->attrs[expanded->count++] = inst->userobj_membership_attr;
+	}
+
+	if (inst->profile_attr) {
+		expanded->attrs[expanded->count++] = inst->profile_attr;
+	}
+
+	if (inst->valuepair_attr) {
+		expanded->attrs[expanded->count++] = inst->valuepair_attr;
+	}
+
+	expanded->attrs[expanded->count] = NULL;
+
+	/*
+	 *	Search for the user object without blocking.
+	 *	Everything else is done once the result arrives.
+	 */
+	rcode = rlm_ldap_find_user_async(inst, thread, request, expanded->attrs,
+					 _ldap_autz_user_found, autz, &autz->query);
+	if (rcode != RLM_MODULE_OK) {
+		talloc_free(autz);
+		return rcode;
+	}
+
+	return unlang_module_yield(request, mod_authorize_resume, mod_authorize_signal, autz);
+}
+
 /** Modify user's object in LDAP
  *
  * Process a modifcation map to update a user object in the LDAP directory.
@@ -1366,6 +1593,7 @@ static int mod_detach(void *instance)
 
 	fr_pool_free(inst->pool);
 	talloc_free(inst->user_map);
+	talloc_free(inst->membership_cache);
 
 	return 0;
 }
@@ -1522,6 +1750,25 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		}
 	}
 
+	if (!inst->async_connections || !inst->async_max_outstanding) {
+		cf_log_err(conf, "Configuration items 'options.async_connections' and "
+			      "'options.async_max_outstanding' must be greater than 0");
+
+		goto error;
+	}
+
+	if (inst->membership_cache_ttl) {
+		if (!inst->cacheable_group_name && !inst->cacheable_group_dn) {
+			cf_log_err(conf, "Configuration item 'group.membership_cache_ttl' requires one of "
+				      "'group.cacheable_name' or 'group.cacheable_dn' to be enabled");
+
+			goto error;
+		}
+
+		inst->membership_cache = rlm_ldap_membership_cache_alloc(inst, inst->membership_cache_max);
+		if (!inst->membership_cache) goto error;
+	}
+
 	/*
 	 *	If we have a *pair* as opposed to a *section*
 	 *	then the module is referencing another ldap module's
@@ -1965,6 +2212,18 @@ error:
 	return -1;
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	return rlm_ldap_thread_init(thread, instance, el);
+}
+
+static int mod_thread_detach(void *thread)
+{
+	rlm_ldap_thread_free(thread);
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	fr_ldap_global_init();
@@ -1990,6 +2249,9 @@ rad_module_t rlm_ldap = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_ldap_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
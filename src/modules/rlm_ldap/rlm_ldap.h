@@ -18,8 +18,53 @@
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/ldap/libfreeradius-ldap.h>
+#include <freeradius-devel/io/time.h>
 
 typedef struct ldap_inst_s rlm_ldap_t;
+typedef struct rlm_ldap_thread rlm_ldap_thread_t;
+typedef struct rlm_ldap_query rlm_ldap_query_t;
+typedef struct rlm_ldap_membership_cache rlm_ldap_membership_cache_t;
+
+/** Called when an asynchronous search or bind completes
+ *
+ * @param[in] request	The query was issued for.
+ * @param[in] conn	The query was performed on.  May be used to parse the result,
+ *			but is only valid for the duration of the callback.
+ * @param[in] status	Result of the query.
+ * @param[in] result	Of a search, or NULL.  Must be freed by the callback with ldap_msgfree.
+ * @param[in] uctx	passed to #rlm_ldap_search_async or #rlm_ldap_bind_async.
+ */
+typedef void (*rlm_ldap_query_cb_t)(REQUEST *request, fr_ldap_conn_t *conn, fr_ldap_rcode_t status,
+				    LDAPMessage *result, void *uctx);
+
+/** A connection owned by a single worker, with its fd in the worker's event list
+ *
+ */
+typedef struct rlm_ldap_async_conn {
+	rlm_ldap_thread_t	*thread;	//!< Thread this connection belongs to.
+	fr_ldap_conn_t		*conn;		//!< libldap handle, NULL if not connected.
+	int			fd;		//!< The handle's fd.
+	rbtree_t		*queries;	//!< Queries sent on this connection, by msgid.
+	uint32_t		max_outstanding;	//!< Maximum number of queries that may be
+							//!< outstanding on this connection.
+} rlm_ldap_async_conn_t;
+
+/** Per-thread asynchronous connections
+ *
+ */
+struct rlm_ldap_thread {
+	rlm_ldap_t const	*inst;		//!< Instance of rlm_ldap.
+	fr_event_list_t		*el;		//!< Event list of the worker.
+
+	rlm_ldap_async_conn_t	*search;	//!< Bound as the admin user.  Each carries many
+						//!< outstanding searches, distinguished by msgid.
+	uint32_t		num_search;	//!< Number of search connections.
+	fr_dlist_t		search_queue;	//!< Searches waiting for a free slot on a search connection.
+
+	rlm_ldap_async_conn_t	bind;		//!< Used for user binds.  Binds change the identity
+						//!< of the connection, so are sent one at a time.
+	fr_dlist_t		bind_queue;	//!< Binds waiting for the bind connection.
+};
 
 typedef struct {
 	vp_tmpl_t	*mech;				//!< SASL mech(s) to try.
@@ -55,6 +100,11 @@ struct ldap_inst_s {
 							//!< issued for.
 #endif
 
+	uint32_t	async_connections;		//!< Number of connections each worker uses for
+							//!< asynchronous searches.
+	uint32_t	async_max_outstanding;		//!< Maximum number of searches outstanding on each
+							//!< of those connections.
+
 	/*
 	 *	User object attributes and filters
 	 */
@@ -102,6 +152,13 @@ struct ldap_inst_s {
 	char const	*cache_attribute;		//!< Sets the attribute we use when creating and retrieving
 							//!< cached group memberships.
 
+	uint32_t	membership_cache_ttl;		//!< How long to cache the group memberships of a user
+							//!< object across requests.  0 disables the cache.
+
+	uint32_t	membership_cache_max;		//!< Maximum number of user objects to cache memberships for.
+
+	rlm_ldap_membership_cache_t *membership_cache;	//!< Memberships shared between all workers.
+
 	fr_dict_attr_t const	*cache_da;		//!< The DA associated with this specific instance of the
 							//!< rlm_ldap module.
 
@@ -166,6 +223,13 @@ struct ldap_inst_s {
 char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_conn_t **pconn,
 			       char const *attrs[], bool force, LDAPMessage **result, rlm_rcode_t *rcode);
 
+rlm_rcode_t rlm_ldap_find_user_async(rlm_ldap_t const *inst, rlm_ldap_thread_t *t, REQUEST *request,
+				     char const *attrs[], rlm_ldap_query_cb_t callback, void *uctx,
+				     rlm_ldap_query_t **query);
+
+char const *rlm_ldap_find_user_result(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_conn_t const *conn,
+				      fr_ldap_rcode_t status, LDAPMessage *result, rlm_rcode_t *rcode);
+
 rlm_rcode_t rlm_ldap_check_access(rlm_ldap_t const *inst, REQUEST *request,
 				  fr_ldap_conn_t const *conn, LDAPMessage *entry);
 
@@ -187,6 +251,11 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(rlm_ldap_t const *inst, REQUEST *requ
 
 rlm_rcode_t rlm_ldap_check_cached(rlm_ldap_t const *inst, REQUEST *request, VALUE_PAIR *check);
 
+rlm_ldap_membership_cache_t *rlm_ldap_membership_cache_alloc(TALLOC_CTX *ctx, uint32_t max);
+
+rlm_rcode_t rlm_ldap_membership_lookup(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_conn_t **pconn,
+				       char const *dn, LDAPMessage *entry);
+
 /*
  *	conn.c - Connection wrappers.
  */
@@ -196,6 +265,21 @@ void		mod_conn_release(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_conn_t
 
 void		*mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout);
 
+int		rlm_ldap_thread_init(rlm_ldap_thread_t *t, rlm_ldap_t const *inst, fr_event_list_t *el);
+
+void		rlm_ldap_thread_free(rlm_ldap_thread_t *t);
+
+rlm_ldap_query_t *rlm_ldap_search_async(rlm_ldap_thread_t *t, REQUEST *request,
+					char const *dn, int scope, char const *filter, char const * const *attrs,
+					LDAPControl **serverctrls,
+					rlm_ldap_query_cb_t callback, void *uctx);
+
+rlm_ldap_query_t *rlm_ldap_bind_async(rlm_ldap_thread_t *t, REQUEST *request,
+				      char const *dn, char const *password,
+				      rlm_ldap_query_cb_t callback, void *uctx);
+
+void		rlm_ldap_query_cancel(rlm_ldap_query_t *query);
+
 /*
  *	clients.c - Dynamic clients (bulk load).
  */
@@ -32,6 +32,41 @@
 
 #include "rlm_ldap.h"
 
+/** Expand the base DN and filter used to search for user objects
+ *
+ * @param[out] base_dn		Where to write a pointer to the base DN.
+ * @param[in] base_dn_buff	Buffer to expand the base DN into (LDAP_MAX_DN_STR_LEN).
+ * @param[out] filter		Where to write a pointer to the filter.  NULL if there's no filter.
+ * @param[in] filter_buff	Buffer to expand the filter into (LDAP_MAX_FILTER_STR_LEN).
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] request		Current request.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int rlm_ldap_user_search_expand(char const **base_dn, char *base_dn_buff,
+				       char const **filter, char *filter_buff,
+				       rlm_ldap_t const *inst, REQUEST *request)
+{
+	*filter = NULL;
+
+	if (inst->userobj_filter) {
+		if (tmpl_expand(filter, filter_buff, LDAP_MAX_FILTER_STR_LEN, request, inst->userobj_filter,
+				fr_ldap_escape_func, NULL) < 0) {
+			REDEBUG("Unable to create filter");
+			return -1;
+		}
+	}
+
+	if (tmpl_expand(base_dn, base_dn_buff, LDAP_MAX_DN_STR_LEN, request,
+			inst->userobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
+		REDEBUG("Unable to create base_dn");
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Retrieve the DN of a user object
  *
  * Retrieves the DN of a user and adds it to the control list as LDAP-UserDN. Will also retrieve any
@@ -57,10 +92,8 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 
 	fr_ldap_rcode_t	status;
 	VALUE_PAIR	*vp = NULL;
-	LDAPMessage	*tmp_msg = NULL, *entry = NULL;
-	int		ldap_errno;
-	int		cnt;
-	char		*dn = NULL;
+	LDAPMessage	*tmp_msg = NULL;
+	char const	*dn;
 	char const	*filter = NULL;
 	char	    	filter_buff[LDAP_MAX_FILTER_STR_LEN];
 	char const	*base_dn;
@@ -111,26 +144,90 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 		(*pconn)->rebound = false;
 	}
 
-	if (inst->userobj_filter) {
-		if (tmpl_expand(&filter, filter_buff, sizeof(filter_buff), request, inst->userobj_filter,
-				fr_ldap_escape_func, NULL) < 0) {
-			REDEBUG("Unable to create filter");
-			*rcode = RLM_MODULE_INVALID;
-
-			return NULL;
-		}
-	}
-
-	if (tmpl_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff), request,
-			inst->userobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
-		REDEBUG("Unable to create base_dn");
+	if (rlm_ldap_user_search_expand(&base_dn, base_dn_buff, &filter, filter_buff, inst, request) < 0) {
 		*rcode = RLM_MODULE_INVALID;
-
 		return NULL;
 	}
 
 	status = fr_ldap_search(result, request, pconn, base_dn,
 				inst->userobj_scope, filter, attrs, serverctrls, NULL);
+
+	dn = rlm_ldap_find_user_result(inst, request, *pconn, status, *result, rcode);
+	if ((freeit || !dn) && *result) {
+		ldap_msgfree(*result);
+		*result = NULL;
+	}
+
+	return dn;
+}
+
+/** Search for a user object, without blocking
+ *
+ * The result should be passed to #rlm_ldap_find_user_result by the callback.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] t Thread specific connections.
+ * @param[in] request Current request.
+ * @param[in] attrs Additional attributes to retrieve, may be NULL.
+ * @param[in] callback to call when the search completes.
+ * @param[in] uctx to pass to the callback.
+ * @param[out] query Handle for the search, which may be passed to #rlm_ldap_query_cancel.
+ * @return
+ *	- #RLM_MODULE_OK if the search was sent.
+ *	- #RLM_MODULE_INVALID if the search parameters couldn't be expanded.
+ *	- #RLM_MODULE_FAIL if the search couldn't be sent.
+ */
+rlm_rcode_t rlm_ldap_find_user_async(rlm_ldap_t const *inst, rlm_ldap_thread_t *t, REQUEST *request,
+				     char const *attrs[], rlm_ldap_query_cb_t callback, void *uctx,
+				     rlm_ldap_query_t **query)
+{
+	static char const *tmp_attrs[] = { NULL };
+
+	char const	*filter = NULL;
+	char	    	filter_buff[LDAP_MAX_FILTER_STR_LEN];
+	char const	*base_dn;
+	char	    	base_dn_buff[LDAP_MAX_DN_STR_LEN];
+	LDAPControl	*serverctrls[] = { inst->userobj_sort_ctrl, NULL };
+
+	if (!attrs) attrs = tmp_attrs;
+
+	if (rlm_ldap_user_search_expand(&base_dn, base_dn_buff, &filter, filter_buff, inst, request) < 0) {
+		return RLM_MODULE_INVALID;
+	}
+
+	*query = rlm_ldap_search_async(t, request, base_dn, inst->userobj_scope, filter, attrs,
+				       serverctrls, callback, uctx);
+	if (!*query) {
+		RPEDEBUG("Failed performing search");
+		return RLM_MODULE_FAIL;
+	}
+
+	return RLM_MODULE_OK;
+}
+
+/** Process the result of a search for a user object
+ *
+ * Retrieves the DN of the user from the result, and adds it to the control list as LDAP-UserDN.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] conn the search was performed on.
+ * @param[in] status of the search.
+ * @param[in] result of the search.  Not freed.
+ * @param[out] rcode The status of the operation, one of the RLM_MODULE_* codes.
+ * @return The user's DN or NULL on error.
+ */
+char const *rlm_ldap_find_user_result(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_conn_t const *conn,
+				      fr_ldap_rcode_t status, LDAPMessage *result, rlm_rcode_t *rcode)
+{
+	VALUE_PAIR	*vp = NULL;
+	LDAPMessage	*entry = NULL;
+	int		ldap_errno;
+	int		cnt;
+	char		*dn = NULL;
+
+	*rcode = RLM_MODULE_FAIL;
+
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
 		break;
@@ -141,11 +238,11 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 		return NULL;
 
 	default:
-		*rcode = RLM_MODULE_FAIL;
 		return NULL;
 	}
 
-	rad_assert(*pconn);
+	rad_assert(conn);
+	rad_assert(result);
 
 	/*
 	 *	Forbid the use of unsorted search results that
@@ -153,40 +250,40 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 	 *	security issue, and likely non deterministic.
 	 */
 	if (!inst->userobj_sort_ctrl) {
-		cnt = ldap_count_entries((*pconn)->handle, *result);
+		cnt = ldap_count_entries(conn->handle, result);
 		if (cnt > 1) {
 			REDEBUG("Ambiguous search result, returned %i unsorted entries (should return 1 or 0).  "
 				"Enable sorting, or specify a more restrictive base_dn, filter or scope", cnt);
 			REDEBUG("The following entries were returned:");
 			RINDENT();
-			for (entry = ldap_first_entry((*pconn)->handle, *result);
+			for (entry = ldap_first_entry(conn->handle, result);
 			     entry;
-			     entry = ldap_next_entry((*pconn)->handle, entry)) {
-				dn = ldap_get_dn((*pconn)->handle, entry);
+			     entry = ldap_next_entry(conn->handle, entry)) {
+				dn = ldap_get_dn(conn->handle, entry);
 				REDEBUG("%s", dn);
 				ldap_memfree(dn);
 			}
 			REXDENT();
 			*rcode = RLM_MODULE_INVALID;
-			goto finish;
+			return NULL;
 		}
 	}
 
-	entry = ldap_first_entry((*pconn)->handle, *result);
+	entry = ldap_first_entry(conn->handle, result);
 	if (!entry) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Failed retrieving entry: %s",
 			ldap_err2string(ldap_errno));
 
-		goto finish;
+		return NULL;
 	}
 
-	dn = ldap_get_dn((*pconn)->handle, entry);
+	dn = ldap_get_dn(conn->handle, entry);
 	if (!dn) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
 
-		goto finish;
+		return NULL;
 	}
 	fr_ldap_util_normalise_dn(dn, dn);
 
@@ -206,12 +303,6 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 	}
 	ldap_memfree(dn);
 
-finish:
-	if ((freeit || (*rcode != RLM_MODULE_OK)) && *result) {
-		ldap_msgfree(*result);
-		*result = NULL;
-	}
-
 	return vp ? vp->vp_strvalue : NULL;
 }
 
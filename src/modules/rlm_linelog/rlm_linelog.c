@@ -27,6 +27,7 @@ RCSID("$Id$")
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
 #include <freeradius-devel/exfile.h>
+#include <freeradius-devel/connection.h>
 
 #ifdef HAVE_FCNTL_H
 #  include <fcntl.h>
@@ -116,6 +117,17 @@ typedef struct linelog_instance_t {
 	linelog_net_t		tcp;			//!< TCP server.
 	linelog_net_t		udp;			//!< UDP server.
 
+	struct {
+		size_t			size;			//!< Flush once this many bytes are queued.
+							///< 0 disables batching.
+		struct timeval		interval;		//!< The longest a line can wait in the queue.
+		size_t			max_queue;		//!< Drop lines once this many bytes are queued.
+		size_t			datagram_size;		//!< The largest UDP datagram we send.
+		struct timeval		connection_timeout;	//!< How long to wait for a socket to open.
+		struct timeval		reconnection_delay;	//!< How long to wait before retrying.
+		bool			enabled;		//!< Whether lines are queued by each thread.
+	} batch;
+
 	CONF_SECTION		*cs;			//!< #CONF_SECTION to use as the root for #log_ref lookups.
 } linelog_instance_t;
 
@@ -123,6 +135,32 @@ typedef struct linelog_conn {
 	int			sockfd;			//!< File descriptor associated with socket
 } linelog_conn_t;
 
+/** Per-thread instance data
+ *
+ * Holds the lines which are waiting to be written, and this thread's
+ * connection to the log destination.
+ */
+typedef struct {
+	linelog_instance_t const *inst;			//!< Instance of linelog.
+	fr_event_list_t		*el;			//!< This thread's event list.
+	fr_connection_t		*conn;			//!< Connection to our log destination.
+	int			fd;			//!< Connected socket, or -1.
+	bool			active;			//!< Whether we're waiting for the socket
+							///< to become writable.
+
+	char			*data;			//!< Queued lines.
+	size_t			used;			//!< How many bytes are queued.
+	size_t			sent;			//!< How many queued bytes have been written.
+
+	size_t			*ends;			//!< Offset of the end of each queued record.
+	size_t			num_records;		//!< How many records are queued.
+
+	fr_event_timer_t const	*ev;			//!< When the queue must next be flushed.
+
+	uint64_t		dropped;		//!< Records discarded because the destination
+							///< was too slow, or unavailable.
+} rlm_linelog_thread_t;
+
 
 static const CONF_PARSER file_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_XLAT, linelog_instance_t, file.name) },
@@ -157,6 +195,15 @@ static const CONF_PARSER tcp_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER batch_config[] = {
+	{ FR_CONF_OFFSET("size", FR_TYPE_SIZE, linelog_instance_t, batch.size), .dflt = "0" },
+	{ FR_CONF_OFFSET("interval", FR_TYPE_TIMEVAL, linelog_instance_t, batch.interval), .dflt = "0.1" },
+	{ FR_CONF_OFFSET("max_queue", FR_TYPE_SIZE, linelog_instance_t, batch.max_queue), .dflt = "1048576" },
+	{ FR_CONF_OFFSET("datagram_size", FR_TYPE_SIZE, linelog_instance_t, batch.datagram_size), .dflt = "1400" },
+	{ FR_CONF_OFFSET("reconnection_delay", FR_TYPE_TIMEVAL, linelog_instance_t, batch.reconnection_delay), .dflt = "1.0" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("destination", FR_TYPE_STRING | FR_TYPE_REQUIRED, linelog_instance_t, log_dst_str) },
 
@@ -173,6 +220,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("tcp", FR_TYPE_SUBSECTION, linelog_instance_t, tcp), .subcs= (void const *) tcp_config },
 	{ FR_CONF_OFFSET("udp", FR_TYPE_SUBSECTION, linelog_instance_t, udp), .subcs = (void const *) udp_config },
 
+	{ FR_CONF_POINTER("batch", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) batch_config },
+
 	/*
 	 *	Deprecated config items
 	 */
@@ -282,6 +331,440 @@ static void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval con
 	return conn;
 }
 
+static void linelog_batch_flush(rlm_linelog_thread_t *t);
+
+/** Remove the records which have been completely written from the queue
+ *
+ * @param[in] t		Thread instance holding the queue.
+ */
+static void linelog_batch_consume(rlm_linelog_thread_t *t)
+{
+	size_t	i, done;
+
+	for (i = 0; (i < t->num_records) && (t->ends[i] <= t->sent); i++);
+	if (i == 0) return;
+
+	done = t->ends[i - 1];
+	t->num_records -= i;
+	if (t->num_records) {
+		size_t j;
+
+		memmove(t->data, t->data + done, t->used - done);
+		memmove(t->ends, t->ends + i, t->num_records * sizeof(t->ends[0]));
+		for (j = 0; j < t->num_records; j++) t->ends[j] -= done;
+	}
+	t->used -= done;
+	t->sent -= done;
+}
+
+static void linelog_fd_set(rlm_linelog_thread_t *t, bool active);
+
+/** Drain any data we received
+ *
+ */
+static void _linelog_conn_read(UNUSED fr_event_list_t *el, int sock, UNUSED int flags, void *uctx)
+{
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+	uint8_t			buffer[1024];
+	ssize_t			slen;
+
+	while ((slen = read(sock, buffer, sizeof(buffer))) > 0);
+
+	if (slen == 0) {
+		if (t->inst->log_dst == LINELOG_DST_UDP) return;
+
+		WARN("rlm_linelog (%s): Connection closed by the other side", t->inst->name);
+		fr_connection_reconnect(t->conn);
+		return;
+	}
+
+	switch (errno) {
+	case EAGAIN:
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+	case EWOULDBLOCK:
+#endif
+	case EINTR:
+	case ECONNREFUSED:	/* ICMP from a UDP collector which isn't listening */
+		return;
+
+	default:
+		ERROR("rlm_linelog (%s): Failed reading from socket: %s", t->inst->name, fr_syserror(errno));
+		fr_connection_reconnect(t->conn);
+		return;
+	}
+}
+
+/** The socket is writable, so write as much of the queue as we can
+ *
+ */
+static void _linelog_conn_writable(UNUSED fr_event_list_t *el, UNUSED int sock, UNUSED int flags, void *uctx)
+{
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+
+	linelog_batch_flush(t);
+}
+
+/** Connection errored
+ *
+ */
+static void _linelog_conn_error(UNUSED fr_event_list_t *el, int sock, UNUSED int flags, int fd_errno, void *uctx)
+{
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+
+	ERROR("rlm_linelog (%s): Connection failed (%i): %s", t->inst->name, sock, fr_syserror(fd_errno));
+
+	fr_connection_reconnect(t->conn);
+}
+
+/** Watch for the socket becoming writable, or only for errors
+ *
+ * We always read from the socket, so that replies from the other side
+ * don't fill our receive buffer.
+ *
+ * @param[in] t		Thread instance containing the connection.
+ * @param[in] active	Whether we have records to write.
+ */
+static void linelog_fd_set(rlm_linelog_thread_t *t, bool active)
+{
+	if (t->fd < 0) return;
+	if (active == t->active) return;
+
+	if (fr_event_fd_insert(t, t->el, t->fd,
+			       _linelog_conn_read, active ? _linelog_conn_writable : NULL,
+			       _linelog_conn_error, t) < 0) {
+		PERROR("rlm_linelog (%s): Failed inserting FD event", t->inst->name);
+		return;
+	}
+	t->active = active;
+}
+
+/** Initialise a new outbound connection
+ *
+ * @param[out] fd_out	Where to write the new file descriptor.
+ * @param[in] uctx	A #rlm_linelog_thread_t.
+ */
+static fr_connection_state_t _linelog_conn_init(int *fd_out, void *uctx)
+{
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+	linelog_instance_t const *inst = t->inst;
+	int			fd = -1;
+
+	switch (inst->log_dst) {
+	case LINELOG_DST_UNIX:
+		DEBUG2("rlm_linelog (%s): Opening UNIX socket at \"%s\"", inst->name, inst->unix_sock.path);
+		fd = fr_socket_client_unix(inst->unix_sock.path, true);
+		break;
+
+	case LINELOG_DST_TCP:
+		DEBUG2("rlm_linelog (%s): Opening TCP connection to %pV:%u",
+		       inst->name, fr_box_ipaddr(inst->tcp.dst_ipaddr), inst->tcp.port);
+		fd = fr_socket_client_tcp(NULL, &inst->tcp.dst_ipaddr, inst->tcp.port, true);
+		break;
+
+	case LINELOG_DST_UDP:
+		DEBUG2("rlm_linelog (%s): Opening UDP connection to %pV:%u",
+		       inst->name, fr_box_ipaddr(inst->udp.dst_ipaddr), inst->udp.port);
+		fd = fr_socket_client_udp(NULL, &inst->udp.dst_ipaddr, inst->udp.port, true);
+		break;
+
+	/*
+	 *	Are not connection oriented destinations
+	 */
+	case LINELOG_DST_INVALID:
+	case LINELOG_DST_FILE:
+	case LINELOG_DST_SYSLOG:
+		rad_assert(0);
+		break;
+	}
+	if (fd < 0) {
+		PERROR("rlm_linelog (%s): Failed opening socket", inst->name);
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	*fd_out = fd;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+/** Process notification that the socket is open
+ *
+ */
+static fr_connection_state_t _linelog_conn_open(int fd, UNUSED fr_event_list_t *el, void *uctx)
+{
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+
+	DEBUG2("rlm_linelog (%s): Socket (%i) connected", t->inst->name, fd);
+
+	t->fd = fd;
+	t->active = true;		/* Force the events to be inserted */
+	linelog_fd_set(t, false);
+
+	linelog_batch_flush(t);
+
+	return FR_CONNECTION_STATE_CONNECTED;
+}
+
+/** Close the socket
+ *
+ * A record which was only partly written to a stream socket can't be
+ * finished on the next connection, so it's discarded.
+ */
+static void _linelog_conn_close(int fd, void *uctx)
+{
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+	size_t			i;
+
+	DEBUG3("rlm_linelog (%s): Closing socket (%i)", t->inst->name, fd);
+	if (shutdown(fd, SHUT_RDWR) < 0) DEBUG3("Shutdown on socket (%i) failed: %s", fd, fr_syserror(errno));
+	if (close(fd) < 0) DEBUG3("Closing socket (%i) failed: %s", fd, fr_syserror(errno));
+
+	t->fd = -1;
+	t->active = false;
+
+	for (i = 0; i < t->num_records; i++) {
+		if (t->ends[i] <= t->sent) continue;
+
+		if ((i == 0) ? (t->sent > 0) : (t->sent > t->ends[i - 1])) {
+			t->sent = t->ends[i];
+			t->dropped++;
+			linelog_batch_consume(t);
+		}
+		break;
+	}
+}
+
+/** Write queued records to a stream socket
+ *
+ * @return
+ *	- 0 if everything was written, or the socket is full.
+ *	- -1 if the connection failed.
+ */
+static int linelog_batch_write_stream(rlm_linelog_thread_t *t)
+{
+	while (t->sent < t->used) {
+		ssize_t slen;
+
+		slen = write(t->fd, t->data + t->sent, t->used - t->sent);
+		if (slen < 0) switch (errno) {
+		case EINTR:
+			continue;
+
+		case EAGAIN:
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
+		case ENOBUFS:
+			return 0;
+
+		default:
+			ERROR("rlm_linelog (%s): Failed writing to socket: %s", t->inst->name, fr_syserror(errno));
+			return -1;
+		}
+
+		t->sent += slen;
+	}
+
+	return 0;
+}
+
+/** Write queued records to a UDP socket, packing as many as fit into each datagram
+ *
+ * Records are never split across datagrams.  A record which is larger than
+ * datagram_size is sent on its own.
+ *
+ * @return
+ *	- 0 if everything was written, or the socket is full.
+ *	- -1 if the connection failed.
+ */
+static int linelog_batch_write_datagram(rlm_linelog_thread_t *t)
+{
+	size_t	i = 0;
+
+	while (t->sent < t->used) {
+		size_t	j, end;
+		ssize_t	slen;
+
+		while (t->ends[i] <= t->sent) i++;
+
+		end = t->ends[i];
+		for (j = i + 1; (j < t->num_records) && ((t->ends[j] - t->sent) <= t->inst->batch.datagram_size); j++) {
+			end = t->ends[j];
+		}
+
+		slen = send(t->fd, t->data + t->sent, end - t->sent, 0);
+		if (slen < 0) switch (errno) {
+		case EINTR:
+			continue;
+
+		case EAGAIN:
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
+		case ENOBUFS:
+			return 0;
+
+		/*
+		 *	The collector isn't listening, or the
+		 *	datagram is too large.  Retrying won't help.
+		 */
+		case ECONNREFUSED:
+		case EMSGSIZE:
+			RATE_LIMIT(WARN("rlm_linelog (%s): Discarding %zu records: %s",
+					t->inst->name, j - i, fr_syserror(errno)));
+			t->dropped += j - i;
+			break;
+
+		default:
+			ERROR("rlm_linelog (%s): Failed writing to socket: %s", t->inst->name, fr_syserror(errno));
+			return -1;
+		}
+
+		t->sent = end;
+		i = j;
+	}
+
+	return 0;
+}
+
+/** Write as much of the queue as the destination will take
+ *
+ * @param[in] t		Thread instance holding the queue.
+ */
+static void linelog_batch_flush(rlm_linelog_thread_t *t)
+{
+	linelog_instance_t const	*inst = t->inst;
+	int				ret;
+
+	if (t->num_records == 0) return;
+
+	switch (inst->log_dst) {
+#ifdef HAVE_SYSLOG_H
+	case LINELOG_DST_SYSLOG:
+	{
+		size_t i, start = 0;
+
+		for (i = 0; i < t->num_records; i++) {
+			syslog(inst->syslog.priority, "%.*s", (int)(t->ends[i] - start), t->data + start);
+			start = t->ends[i];
+		}
+		t->sent = t->used;
+		linelog_batch_consume(t);
+	}
+		return;
+#endif
+
+	case LINELOG_DST_UDP:
+		if (t->fd < 0) return;	/* The open callback flushes the queue */
+		ret = linelog_batch_write_datagram(t);
+		break;
+
+	case LINELOG_DST_TCP:
+	case LINELOG_DST_UNIX:
+		if (t->fd < 0) return;
+		ret = linelog_batch_write_stream(t);
+		break;
+
+	default:
+		rad_assert(0);
+		return;
+	}
+
+	linelog_batch_consume(t);
+
+	if (ret < 0) {
+		fr_connection_reconnect(t->conn);
+		return;
+	}
+
+	linelog_fd_set(t, (t->num_records > 0));
+}
+
+/** Flush the queue, because its oldest record has waited long enough
+ *
+ */
+static void _linelog_batch_timer(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+
+	t->ev = NULL;
+	linelog_batch_flush(t);
+}
+
+/** Add a record to this thread's queue
+ *
+ * For syslog, each entry in the vector is a separate message.  Otherwise
+ * the whole vector is one record, which is never split across datagrams.
+ *
+ * @param[in] t		Thread instance holding the queue.
+ * @param[in] request	The current request.
+ * @param[in] vector	The data to log.
+ * @param[in] vector_len	Number of entries in the vector.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the queue is full, and the record was discarded.
+ */
+static int linelog_batch_queue(rlm_linelog_thread_t *t, REQUEST *request, struct iovec *vector, size_t vector_len)
+{
+	linelog_instance_t const	*inst = t->inst;
+	size_t				i, len = 0, records;
+
+	records = (inst->log_dst == LINELOG_DST_SYSLOG) ? vector_len : 1;
+
+	for (i = 0; i < vector_len; i++) len += vector[i].iov_len;
+
+	if ((t->used + len) > inst->batch.max_queue) {
+		t->dropped++;
+		RATE_LIMIT(RWARN("Log queue is full, discarding message (%" PRIu64 " discarded)", t->dropped));
+		return -1;
+	}
+
+	if ((t->used + len) > talloc_array_length(t->data)) {
+		size_t size = talloc_array_length(t->data);
+
+		while (size < (t->used + len)) size *= 2;
+		if (size > inst->batch.max_queue) size = inst->batch.max_queue;
+
+		MEM(t->data = talloc_realloc(t, t->data, char, size));
+	}
+
+	if ((t->num_records + records) > talloc_array_length(t->ends)) {
+		size_t size = talloc_array_length(t->ends) * 2;
+
+		if (size < (t->num_records + records)) size = t->num_records + records;
+
+		MEM(t->ends = talloc_realloc(t, t->ends, size_t, size));
+	}
+
+	for (i = 0; i < vector_len; i++) {
+		memcpy(t->data + t->used, vector[i].iov_base, vector[i].iov_len);
+		t->used += vector[i].iov_len;
+
+		if (records > 1) t->ends[t->num_records++] = t->used;
+	}
+	if (records == 1) t->ends[t->num_records++] = t->used;
+
+	RDEBUG3("Queued %zu bytes, %zu bytes are waiting", len, t->used - t->sent);
+
+	if (t->used >= inst->batch.size) {
+		linelog_batch_flush(t);
+		return 0;
+	}
+
+	if (!t->ev) {
+		struct timeval now, when;
+
+		gettimeofday(&now, NULL);
+		fr_timeval_add(&when, &now, &inst->batch.interval);
+
+		if (fr_event_timer_insert(t, t->el, &t->ev, &when, _linelog_batch_timer, t) < 0) {
+			RPERROR("Failed inserting flush timer");
+			linelog_batch_flush(t);
+		}
+	}
+
+	return 0;
+}
+
 static int mod_detach(void *instance)
 {
 	linelog_instance_t *inst = instance;
@@ -325,6 +808,45 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 	snprintf(prefix, sizeof(prefix), "rlm_linelog (%s)", inst->name);
 
+	/*
+	 *	Lines are queued by each thread, and written in
+	 *	batches from the thread's event loop.
+	 */
+	if (inst->batch.size > 0) {
+		if (inst->log_dst == LINELOG_DST_FILE) {
+			cf_log_err(conf, "Batching is not supported when writing to files");
+			return -1;
+		}
+
+		FR_SIZE_BOUND_CHECK("batch.max_queue", inst->batch.max_queue, >=, inst->batch.size);
+		FR_SIZE_BOUND_CHECK("batch.max_queue", inst->batch.max_queue, <=, (size_t)(256 * 1024 * 1024));
+		FR_SIZE_BOUND_CHECK("batch.datagram_size", inst->batch.datagram_size, >=, (size_t)64);
+		FR_SIZE_BOUND_CHECK("batch.datagram_size", inst->batch.datagram_size, <=, (size_t)65507);
+		FR_TIMEVAL_BOUND_CHECK("batch.interval", &inst->batch.interval, >=, 0, 1000);
+		FR_TIMEVAL_BOUND_CHECK("batch.interval", &inst->batch.interval, <=, 60, 0);
+		FR_TIMEVAL_BOUND_CHECK("batch.reconnection_delay", &inst->batch.reconnection_delay, >=, 0, 100000);
+
+		switch (inst->log_dst) {
+		case LINELOG_DST_UNIX:
+			inst->batch.connection_timeout = inst->unix_sock.timeout;
+			break;
+
+		case LINELOG_DST_TCP:
+			inst->batch.connection_timeout = inst->tcp.timeout;
+			break;
+
+		case LINELOG_DST_UDP:
+			inst->batch.connection_timeout = inst->udp.timeout;
+			break;
+
+		default:
+			break;
+		}
+		if (!timerisset(&inst->batch.connection_timeout)) inst->batch.connection_timeout.tv_sec = 1;
+
+		inst->batch.enabled = true;
+	}
+
 	/*
 	 *	Setup the logging destination
 	 */
@@ -389,6 +911,8 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		cf_log_err(conf, "Unix sockets are not supported on this sytem");
 		return -1;
 #else
+		if (inst->batch.enabled) break;
+
 		inst->pool = module_connection_pool_init(cf_section_find(conf, "unix", NULL),
 							 inst, mod_conn_create, NULL, prefix, NULL, NULL);
 		if (!inst->pool) return -1;
@@ -396,12 +920,16 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		break;
 
 	case LINELOG_DST_UDP:
+		if (inst->batch.enabled) break;
+
 		inst->pool = module_connection_pool_init(cf_section_find(conf, "udp", NULL),
 							 inst, mod_conn_create, NULL, prefix, NULL, NULL);
 		if (!inst->pool) return -1;
 		break;
 
 	case LINELOG_DST_TCP:
+		if (inst->batch.enabled) break;
+
 		inst->pool = module_connection_pool_init(cf_section_find(conf, "tcp", NULL),
 							 inst, mod_conn_create, NULL, prefix, NULL, NULL);
 		if (!inst->pool) return -1;
@@ -418,6 +946,75 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+/** Create the queue and connection for this thread
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_linelog.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	linelog_instance_t	*inst = instance;
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(thread, rlm_linelog_thread_t);
+	char			prefix[100];
+
+	t->inst = inst;
+	t->el = el;
+	t->fd = -1;
+
+	if (!inst->batch.enabled) return 0;
+
+	MEM(t->data = talloc_array(t, char, (inst->batch.max_queue < 4096) ? inst->batch.max_queue : 4096));
+	MEM(t->ends = talloc_array(t, size_t, 64));
+
+	if (inst->log_dst == LINELOG_DST_SYSLOG) return 0;
+
+	snprintf(prefix, sizeof(prefix), "rlm_linelog (%s)", inst->name);
+
+	t->conn = fr_connection_alloc(t, el, &inst->batch.connection_timeout, &inst->batch.reconnection_delay,
+				      _linelog_conn_init, _linelog_conn_open, _linelog_conn_close,
+				      prefix, t);
+	if (!t->conn) return -1;
+
+	fr_connection_start(t->conn);
+
+	return 0;
+}
+
+/** Write anything which is still queued, and close the connection
+ *
+ * @param[in] thread	specific data.
+ * @return 0
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(thread, rlm_linelog_thread_t);
+
+	if (!t->inst->batch.enabled) return 0;
+
+	if (t->ev) fr_event_timer_delete(t->el, &t->ev);
+
+	linelog_batch_flush(t);
+	if (t->num_records > 0) {
+		WARN("rlm_linelog (%s): Discarding %zu records which couldn't be written",
+		     t->inst->name, t->num_records);
+		t->dropped += t->num_records;
+	}
+
+	if (t->dropped > 0) {
+		WARN("rlm_linelog (%s): %" PRIu64 " records were discarded by this thread",
+		     t->inst->name, t->dropped);
+	}
+
+	TALLOC_FREE(t->conn);
+
+	return 0;
+}
+
 /** Escape unprintable characters
  *
  * - Newline is escaped as ``\\n``.
@@ -460,8 +1057,8 @@ static size_t linelog_escape_func(UNUSED REQUEST *request,
  *	- #RLM_MODULE_FAIL if we failed writing the message.
  *	- #RLM_MODULE_OK on success.
  */
-static rlm_rcode_t mod_do_linelog(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_do_linelog(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_do_linelog(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_do_linelog(void *instance, void *thread, REQUEST *request)
 {
 	linelog_conn_t		*conn;
 	struct timeval		*timeout = NULL;
@@ -642,6 +1239,16 @@ build_vector:
 		goto finish;
 	}
 
+	/*
+	 *	Queue the data, and let the thread's event loop
+	 *	write it out.
+	 */
+	if (inst->batch.enabled) {
+		if (linelog_batch_queue(talloc_get_type_abort(thread, rlm_linelog_thread_t),
+					request, vector_p, vector_len) < 0) rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
 	/*
 	 *	Reserve a handle, write out the data, close the handle
 	 */
@@ -795,9 +1402,12 @@ rad_module_t rlm_linelog = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "linelog",
 	.inst_size	= sizeof(linelog_instance_t),
+	.thread_inst_size	= sizeof(rlm_linelog_thread_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 	.detach		= mod_detach,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_do_linelog,
 		[MOD_AUTHORIZE]		= mod_do_linelog,
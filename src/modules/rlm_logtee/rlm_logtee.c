@@ -52,6 +52,17 @@ RCSID("$Id$")
 
 #include <sys/uio.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+/*
+ *	The most messages we write with one writev()
+ */
+#define LOGTEE_MAX_IOV	64
+
 typedef enum {
 	LOGTEE_DST_INVALID = 0,
 	LOGTEE_DST_FILE,				//!< Log to a file.
@@ -69,6 +80,38 @@ static FR_NAME_NUMBER const logtee_dst_table[] = {
 	{  NULL , -1 }
 };
 
+/** Message classes, in the order they're written
+ *
+ * When the buffer is full, messages of the lowest class are discarded first.
+ */
+typedef enum {
+	LOGTEE_CLASS_ERROR = 0,				//!< Errors.
+	LOGTEE_CLASS_WARN,				//!< Warnings.
+	LOGTEE_CLASS_INFO,				//!< Everything else.
+	LOGTEE_CLASS_MAX
+} logtee_class_t;
+
+/** Counters shared by all of the threads
+ *
+ */
+typedef struct {
+	atomic_uint_fast64_t	queued;			//!< Messages waiting to be written.
+	atomic_uint_fast64_t	queued_bytes;		//!< Bytes waiting to be written.
+	atomic_uint_fast64_t	written;		//!< Messages written.
+	atomic_uint_fast64_t	dropped;		//!< Messages discarded.
+	atomic_uint_fast64_t	reconnects;		//!< Connections which failed, and were re-opened.
+} logtee_stats_t;
+
+/** A FIFO of messages of one class
+ *
+ */
+typedef struct {
+	char			**msg;			//!< Ring of messages (talloced strings).
+	uint32_t		head;			//!< Oldest message.
+	uint32_t		num;			//!< Messages in the ring.
+	uint32_t		size;			//!< Capacity of the ring.
+} logtee_queue_t;
+
 typedef struct logtee_net {
 	fr_ipaddr_t		dst_ipaddr;		//!< Network server.
 	fr_ipaddr_t		src_ipaddr;		//!< Send requests from a given src_ipaddr.
@@ -88,7 +131,10 @@ typedef struct {
 	logtee_dst_t		log_dst;		//!< Logging destination.
 	char const		*log_dst_str;		//!< Logging destination string.
 
-	size_t			buffer_depth;		//!< How big our circular buffer should be.
+	size_t			buffer_depth;		//!< The most messages each thread buffers.
+	size_t			buffer_size;		//!< The most bytes each thread buffers.
+
+	logtee_stats_t		*stats;			//!< Counters for all threads.
 
 	struct {
 		char const		*name;			//!< File to write to.
@@ -124,7 +170,13 @@ typedef struct {
 	fr_event_list_t		*el;			//!< This thread's event list.
 	fr_connection_t		*conn;			//!< Connection to our log destination.
 
-	fr_fring_t		*fring;			//!< Circular buffer used to batch up messages.
+	logtee_queue_t		queue[LOGTEE_CLASS_MAX];	//!< Messages waiting to be written.
+	uint32_t		queued;			//!< Messages in all of the queues.
+	size_t			queued_bytes;		//!< Bytes in all of the queues.
+
+	int			partial;		//!< Class of the message which was partly written,
+							///< or -1.
+	size_t			offset;			//!< How much of that message was written.
 
 	bool			pending;		//!< We have pending messages to write.
 
@@ -165,6 +217,7 @@ static const CONF_PARSER tcp_config[] = {
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("destination", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_logtee_t, log_dst_str) },
 	{ FR_CONF_OFFSET("buffer_depth", FR_TYPE_SIZE, rlm_logtee_t, buffer_depth), .dflt = "10000" },
+	{ FR_CONF_OFFSET("buffer_size", FR_TYPE_SIZE, rlm_logtee_t, buffer_size), .dflt = "1048576" },
 
 	{ FR_CONF_OFFSET("delimiter", FR_TYPE_STRING, rlm_logtee_t, delimiter), .dflt = "\n" },
 	{ FR_CONF_OFFSET("format", FR_TYPE_TMPL, rlm_logtee_t, log_fmt), .dflt = "%n - %s", .quote = T_DOUBLE_QUOTED_STRING },
@@ -192,6 +245,166 @@ static void logtee_it(fr_log_type_t type, fr_log_lvl_t lvl, REQUEST *request, ch
 
 static rlm_rcode_t mod_insert_logtee(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
 
+/** Map a log type to the class of message
+ *
+ */
+static inline logtee_class_t logtee_class(fr_log_type_t type)
+{
+	switch (type) {
+	case L_ERR:
+	case L_DBG_ERR:
+	case L_DBG_ERR_REQ:
+		return LOGTEE_CLASS_ERROR;
+
+	case L_WARN:
+	case L_DBG_WARN:
+	case L_DBG_WARN_REQ:
+		return LOGTEE_CLASS_WARN;
+
+	default:
+		return LOGTEE_CLASS_INFO;
+	}
+}
+
+/** Add a message to the tail of a queue
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the queue couldn't be grown.
+ */
+static int logtee_queue_push(rlm_logtee_thread_t *t, logtee_queue_t *q, char *msg)
+{
+	if (q->num == q->size) {
+		uint32_t	size = q->size ? q->size * 2 : 64;
+		char		**array;
+		uint32_t	i;
+
+		array = talloc_array(t, char *, size);
+		if (!array) return -1;
+
+		for (i = 0; i < q->num; i++) array[i] = q->msg[(q->head + i) % q->size];
+		talloc_free(q->msg);
+
+		q->msg = array;
+		q->head = 0;
+		q->size = size;
+	}
+
+	q->msg[(q->head + q->num) % q->size] = msg;
+	q->num++;
+
+	return 0;
+}
+
+/** Remove the message at the head of a queue
+ *
+ * @return the message, which the caller must free.
+ */
+static char *logtee_queue_pop(logtee_queue_t *q)
+{
+	char *msg;
+
+	if (q->num == 0) return NULL;
+
+	msg = q->msg[q->head];
+	q->head = (q->head + 1) % q->size;
+	q->num--;
+
+	return msg;
+}
+
+/** Free the message at the head of a queue, and update the counters
+ *
+ * @param[in] t		Thread instance holding the queues.
+ * @param[in] class	of message to remove.
+ * @param[in] written	Whether the message was written (or discarded).
+ */
+static void logtee_msg_done(rlm_logtee_thread_t *t, logtee_class_t class, bool written)
+{
+	logtee_stats_t	*stats = t->inst->stats;
+	char		*msg;
+	size_t		len;
+
+	msg = logtee_queue_pop(&t->queue[class]);
+	if (!msg) return;
+
+	len = talloc_array_length(msg) - 1;
+
+	t->queued--;
+	t->queued_bytes -= len;
+	if ((int)class == t->partial) {
+		t->partial = -1;
+		t->offset = 0;
+	}
+
+	atomic_fetch_sub_explicit(&stats->queued, 1, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&stats->queued_bytes, len, memory_order_relaxed);
+	if (written) {
+		atomic_fetch_add_explicit(&stats->written, 1, memory_order_relaxed);
+	} else {
+		atomic_fetch_add_explicit(&stats->dropped, 1, memory_order_relaxed);
+	}
+
+	talloc_free(msg);
+}
+
+/** Make room for a new message
+ *
+ * Discards the oldest messages of the lowest class, down to the class
+ * of the new message.  A message which was partly written is never
+ * discarded.
+ *
+ * @return
+ *	- 0 if there's room.
+ *	- -1 if the new message must be discarded.
+ */
+static int logtee_make_room(rlm_logtee_thread_t *t, logtee_class_t class, size_t len)
+{
+	rlm_logtee_t const	*inst = t->inst;
+	int			i;
+
+	for (i = LOGTEE_CLASS_MAX - 1; i >= (int)class; i--) {
+		while ((t->queued >= inst->buffer_depth) || ((t->queued_bytes + len) > inst->buffer_size)) {
+			if (t->queue[i].num == 0) break;
+			if ((t->partial == i) && (t->queue[i].num == 1)) break;
+
+			/*
+			 *	Discard the oldest message, unless
+			 *	it's partly written, in which case
+			 *	discard the next one.
+			 */
+			if (t->partial == i) {
+				logtee_queue_t	*q = &t->queue[i];
+				uint32_t	next = (q->head + 1) % q->size;
+				char		*msg = q->msg[q->head];
+
+				q->msg[q->head] = q->msg[next];
+				q->msg[next] = msg;
+
+				t->partial = -1;	/* Keep the offset */
+				logtee_msg_done(t, i, false);
+				t->partial = i;
+				continue;
+			}
+
+			logtee_msg_done(t, i, false);
+		}
+	}
+
+	if ((t->queued >= inst->buffer_depth) || ((t->queued_bytes + len) > inst->buffer_size)) return -1;
+
+	return 0;
+}
+
+/** Re-open the connection, counting the failure
+ *
+ */
+static void logtee_reconnect(rlm_logtee_thread_t *t)
+{
+	atomic_fetch_add_explicit(&t->inst->stats->reconnects, 1, memory_order_relaxed);
+	fr_connection_reconnect(t->conn);
+}
+
 /** Connection errored
  *
  */
@@ -204,7 +417,7 @@ static void _logtee_conn_error(UNUSED fr_event_list_t *el, int sock, UNUSED int
 	/*
 	 *	Something bad happened... Fix it...
 	 */
-	fr_connection_reconnect(t->conn);
+	logtee_reconnect(t);
 }
 
 /** Drain any data we received
@@ -229,7 +442,7 @@ static void _logtee_conn_read(UNUSED fr_event_list_t *el, int sock, UNUSED int f
 		case ETIMEDOUT:
 		case EIO:
 		case ENXIO:
-			fr_connection_reconnect(t->conn);
+			logtee_reconnect(t);
 			return;
 
 		/*
@@ -244,17 +457,68 @@ static void _logtee_conn_read(UNUSED fr_event_list_t *el, int sock, UNUSED int f
 
 /** There's space available to write data, so do that...
  *
+ * Messages are written in class order, errors first, with as many as
+ * possible in each writev().  For UDP each message is a datagram.
  */
 static void _logtee_conn_writable(UNUSED fr_event_list_t *el, int sock, UNUSED int flags, void *uctx)
 {
 	rlm_logtee_thread_t	*t = talloc_get_type_abort(uctx, rlm_logtee_thread_t);
-	char			*msg;
+	rlm_logtee_t const	*inst = t->inst;
+	struct iovec		iov[LOGTEE_MAX_IOV * 2];
+	char			*msg[LOGTEE_MAX_IOV];
+	logtee_class_t		class[LOGTEE_MAX_IOV];
+	int			max;
 
-	/*
-	 *	Fixme in general...
-	 */
-	while ((msg = fr_fring_next(t->fring))) {
-		if (write(sock, msg, talloc_array_length(msg) - 1) < 0) {
+	max = (inst->log_dst == LOGTEE_DST_UDP) ? 1 : LOGTEE_MAX_IOV;
+
+	while (t->queued > 0) {
+		uint32_t	taken[LOGTEE_CLASS_MAX] = { 0 };
+		size_t		skip = 0, left;
+		ssize_t		slen;
+		int		num = 0, i, c;
+
+		/*
+		 *	A message which was partly written must
+		 *	be finished before anything else.
+		 */
+		if (t->partial >= 0) {
+			c = t->partial;
+			msg[num] = t->queue[c].msg[t->queue[c].head];
+			class[num++] = c;
+			taken[c] = 1;
+			skip = t->offset;
+		}
+
+		for (c = 0; (c < LOGTEE_CLASS_MAX) && (num < max); c++) {
+			logtee_queue_t *q = &t->queue[c];
+
+			while ((taken[c] < q->num) && (num < max)) {
+				msg[num] = q->msg[(q->head + taken[c]) % q->size];
+				class[num++] = c;
+				taken[c]++;
+			}
+		}
+
+		for (i = 0; i < num; i++) {
+			iov[i * 2].iov_base = msg[i];
+			iov[i * 2].iov_len = talloc_array_length(msg[i]) - 1;
+			memcpy(&iov[(i * 2) + 1].iov_base, &inst->delimiter, sizeof(iov[(i * 2) + 1].iov_base));
+			iov[(i * 2) + 1].iov_len = inst->delimiter_len;
+		}
+
+		if (skip > 0) {
+			if (skip < iov[0].iov_len) {
+				iov[0].iov_base = (char *)iov[0].iov_base + skip;
+				iov[0].iov_len -= skip;
+			} else {
+				iov[1].iov_base = (char *)iov[1].iov_base + (skip - iov[0].iov_len);
+				iov[1].iov_len -= (skip - iov[0].iov_len);
+				iov[0].iov_len = 0;
+			}
+		}
+
+		slen = writev(sock, iov, num * 2);
+		if (slen < 0) {
 			switch (errno) {
 			case EAGAIN:
 #if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
@@ -270,7 +534,7 @@ static void _logtee_conn_writable(UNUSED fr_event_list_t *el, int sock, UNUSED i
 			case ENXIO:
 			case EPIPE:
 			case ENETDOWN:
-				fr_connection_reconnect(t->conn);
+				logtee_reconnect(t);
 				return;
 
 			/*
@@ -279,11 +543,34 @@ static void _logtee_conn_writable(UNUSED fr_event_list_t *el, int sock, UNUSED i
 			 */
 			default:
 				rad_assert(0);
+				logtee_reconnect(t);
+				return;
 			}
 		}
-		write(sock, t->inst->delimiter, t->inst->delimiter_len);
+
+		/*
+		 *	Remove the messages which were written,
+		 *	and remember how much of the next one
+		 *	was written.
+		 */
+		left = slen + skip;
+		for (i = 0; i < num; i++) {
+			size_t len = talloc_array_length(msg[i]) - 1 + inst->delimiter_len;
+
+			if (left < len) break;
+
+			left -= len;
+			logtee_msg_done(t, class[i], true);
+		}
+
+		if (left > 0) {
+			t->partial = class[i];
+			t->offset = left;
+			return;			/* The socket is full */
+		}
 	}
 
+	t->pending = false;
 	logtee_fd_idle(t);
 }
 
@@ -320,11 +607,19 @@ static void logtee_fd_active(rlm_logtee_thread_t *t)
 /** Shutdown/close a file descriptor
  *
  */
-static void _logtee_conn_close(int fd, UNUSED void *uctx)
+static void _logtee_conn_close(int fd, void *uctx)
 {
+	rlm_logtee_thread_t	*t = talloc_get_type_abort(uctx, rlm_logtee_thread_t);
+
 	DEBUG3("Closing socket (%i)", fd);
 	if (shutdown(fd, SHUT_RDWR) < 0) DEBUG3("Shutdown on socket (%i) failed: %s", fd, fr_syserror(errno));
 	if (close(fd) < 0) DEBUG3("Closing socket (%i) failed: %s", fd, fr_syserror(errno));
+
+	/*
+	 *	The rest of a partly written message can't
+	 *	be sent on a new connection.
+	 */
+	if (t->partial >= 0) logtee_msg_done(t, t->partial, false);
 }
 
 /** Process notification that fd is open
@@ -415,6 +710,9 @@ static void logtee_it(fr_log_type_t type, fr_log_lvl_t lvl, REQUEST *request, ch
 	fr_cursor_t		cursor;
 	VALUE_PAIR		*vp;
 	log_dst_t		*dst;
+	logtee_class_t		class;
+	size_t			len;
+	int			ret;
 
 	rad_assert(t->msg->vp_length == 0);	/* Should have been cleared before returning */
 
@@ -442,10 +740,27 @@ static void logtee_it(fr_log_type_t type, fr_log_lvl_t lvl, REQUEST *request, ch
 	 */
 	dst = request->log.dst;
 	request->log.dst = NULL;
-	if (tmpl_aexpand(t, &exp, request, inst->log_fmt, NULL, NULL) < 0) goto finish;
+	ret = tmpl_aexpand(t, &exp, request, inst->log_fmt, NULL, NULL);
 	request->log.dst = dst;
+	if (ret < 0) goto finish;
+
+	/*
+	 *	Insert it into the buffer, discarding older
+	 *	messages of the same or a lower class if
+	 *	the buffer is full.
+	 */
+	class = logtee_class(type);
+	len = talloc_array_length(exp) - 1;
+	if ((logtee_make_room(t, class, len) < 0) || (logtee_queue_push(t, &t->queue[class], exp) < 0)) {
+		talloc_free(exp);
+		atomic_fetch_add_explicit(&inst->stats->dropped, 1, memory_order_relaxed);
+		goto finish;
+	}
 
-	fr_fring_overwrite(t->fring, exp);	/* Insert it into the buffer */
+	t->queued++;
+	t->queued_bytes += len;
+	atomic_fetch_add_explicit(&inst->stats->queued, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&inst->stats->queued_bytes, len, memory_order_relaxed);
 
 	if (!t->pending) {
 		t->pending = true;
@@ -513,10 +828,9 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instanc
 	rlm_logtee_t		*inst = talloc_get_type_abort(instance, rlm_logtee_t);
 	rlm_logtee_thread_t	*t = talloc_get_type_abort(thread, rlm_logtee_thread_t);
 
-	MEM(t->fring = fr_fring_alloc(t, inst->buffer_depth, false));
-
 	t->inst = inst;
 	t->el = el;
+	t->partial = -1;
 
 	/*
 	 *	Pre-allocate temporary attributes
@@ -540,6 +854,59 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instanc
 	return 0;
 }
 
+/** Close the connection, and discard any messages which weren't written
+ *
+ * @param[in] thread	specific data.
+ * @return 0
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_logtee_thread_t	*t = talloc_get_type_abort(thread, rlm_logtee_thread_t);
+	int			i;
+
+	TALLOC_FREE(t->conn);
+
+	for (i = 0; i < LOGTEE_CLASS_MAX; i++) {
+		while (t->queue[i].num > 0) logtee_msg_done(t, i, false);
+	}
+
+	return 0;
+}
+
+/** Return one of the counters for this logtee
+ *
+ * e.g. %{logtee_stats:dropped}
+ *
+ * The counters are "queued", "queued_bytes", "written", "dropped", and "reconnects".
+ */
+static ssize_t logtee_stats_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
+				 void const *mod_inst, UNUSED void const *xlat_inst,
+				 REQUEST *request, char const *fmt)
+{
+	rlm_logtee_t const	*inst = mod_inst;
+	uint64_t		value;
+
+	while (isspace((int) *fmt)) fmt++;
+
+	if (strcmp(fmt, "queued") == 0) {
+		value = atomic_load(&inst->stats->queued);
+	} else if (strcmp(fmt, "queued_bytes") == 0) {
+		value = atomic_load(&inst->stats->queued_bytes);
+	} else if (strcmp(fmt, "written") == 0) {
+		value = atomic_load(&inst->stats->written);
+	} else if (strcmp(fmt, "dropped") == 0) {
+		value = atomic_load(&inst->stats->dropped);
+	} else if (strcmp(fmt, "reconnects") == 0) {
+		value = atomic_load(&inst->stats->reconnects);
+	} else {
+		REDEBUG("Unknown logtee statistic \"%s\"", fmt);
+		return -1;
+	}
+
+	*out = talloc_typed_asprintf(ctx, "%" PRIu64, value);
+	return talloc_array_length(*out) - 1;
+}
+
 /*
  *	Instantiate the module.
  */
@@ -588,6 +955,17 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 	FR_SIZE_BOUND_CHECK("buffer_depth", inst->buffer_depth, >=, (size_t)1);
 	FR_SIZE_BOUND_CHECK("buffer_depth", inst->buffer_depth, <=, (size_t)1000000);	/* 1 Million messages */
+	FR_SIZE_BOUND_CHECK("buffer_size", inst->buffer_size, >=, (size_t)4096);
+	FR_SIZE_BOUND_CHECK("buffer_size", inst->buffer_size, <=, (size_t)(256 * 1024 * 1024));
+
+	MEM(inst->stats = talloc_zero(inst, logtee_stats_t));
+
+	{
+		char buffer[256];
+
+		snprintf(buffer, sizeof(buffer), "%s_stats", inst->name);
+		xlat_register(inst, buffer, logtee_stats_xlat, NULL, NULL, 0, 0);
+	}
 
 	/*
 	 *	Setup the logging destination
@@ -632,6 +1010,7 @@ rad_module_t rlm_logtee = {
 	.config			= module_config,
 	.instantiate		= mod_instantiate,
 	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_insert_logtee,
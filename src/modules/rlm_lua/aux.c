@@ -119,6 +119,89 @@ static int _aux_log_error(lua_State *L)
 	return 0;
 }
 
+/** Lua wrappers around the FFI attribute access functions in jit.c
+ *
+ * Defines the "pair" table.  Attributes are looked up once by name, and
+ * then cached.  The current request is read from the fr_request global,
+ * which do_lua sets before calling a function.
+ */
+static char const aux_jit_pair_funcs[] =
+	"local ffi = require(\"ffi\")\n"
+	"ffi.cdef [[\n"
+	"	void const *fr_lua_attr_by_name(char const *name);\n"
+	"	void *fr_lua_pair_find(void *request, int list, void const *da, int index);\n"
+	"	void *fr_lua_pair_next(void *vp, void const *da);\n"
+	"	char const *fr_lua_pair_name(void const *vp);\n"
+	"	int fr_lua_pair_kind(void const *vp);\n"
+	"	int64_t fr_lua_pair_get_int(void const *vp);\n"
+	"	double fr_lua_pair_get_number(void const *vp);\n"
+	"	size_t fr_lua_pair_get_string(void const *vp, char const **out);\n"
+	"	size_t fr_lua_pair_print(void const *vp, char *out, size_t outlen);\n"
+	"	int fr_lua_pair_set_number(void *request, int list, void const *da, int index, double value);\n"
+	"	int fr_lua_pair_set_string(void *request, int list, void const *da, int index, char const *value, size_t len);\n"
+	"	int fr_lua_pair_delete(void *request, int list, void const *da, int index);\n"
+	"]]\n"
+	"local lib = ffi.load(\"freeradius-lua\")\n"
+	"local raise = error\n"
+	"local lists = { request = 0, reply = 1, control = 2, state = 3 }\n"
+	"local attrs = {}\n"
+	"local strp = ffi.new(\"char const *[1]\")\n"
+	"local buff = ffi.new(\"char[1024]\")\n"
+	"local function attr(name)\n"
+	"	local da = attrs[name]\n"
+	"	if da == nil then\n"
+	"		da = lib.fr_lua_attr_by_name(name)\n"
+	"		if da == nil then raise(\"Unknown attribute \" .. name) end\n"
+	"		attrs[name] = da\n"
+	"	end\n"
+	"	return da\n"
+	"end\n"
+	"local function list(name)\n"
+	"	local l = lists[name]\n"
+	"	if l == nil then raise(\"Unknown list \" .. tostring(name)) end\n"
+	"	return l\n"
+	"end\n"
+	"local function value(vp)\n"
+	"	local kind = lib.fr_lua_pair_kind(vp)\n"
+	"	if kind == 0 then return tonumber(lib.fr_lua_pair_get_int(vp)) end\n"
+	"	if kind == 1 then return lib.fr_lua_pair_get_number(vp) end\n"
+	"	if kind == 2 then\n"
+	"		local len = lib.fr_lua_pair_get_string(vp, strp)\n"
+	"		return ffi.string(strp[0], len)\n"
+	"	end\n"
+	"	return ffi.string(buff, lib.fr_lua_pair_print(vp, buff, 1024))\n"
+	"end\n"
+	"pair = {}\n"
+	"function pair.get(l, name, index)\n"
+	"	local vp = lib.fr_lua_pair_find(fr_request, list(l), attr(name), index or 0)\n"
+	"	if vp == nil then return nil end\n"
+	"	return value(vp)\n"
+	"end\n"
+	"function pair.set(l, name, v, index)\n"
+	"	local ret\n"
+	"	if type(v) == \"number\" then\n"
+	"		ret = lib.fr_lua_pair_set_number(fr_request, list(l), attr(name), index or 0, v)\n"
+	"	else\n"
+	"		v = tostring(v)\n"
+	"		ret = lib.fr_lua_pair_set_string(fr_request, list(l), attr(name), index or 0, v, #v)\n"
+	"	end\n"
+	"	if ret < 0 then raise(\"Failed setting \" .. name) end\n"
+	"end\n"
+	"function pair.delete(l, name, index)\n"
+	"	return lib.fr_lua_pair_delete(fr_request, list(l), attr(name), index or 0) == 0\n"
+	"end\n"
+	"function pair.pairs(l, name)\n"
+	"	local da = nil\n"
+	"	if name then da = attr(name) end\n"
+	"	local vp = lib.fr_lua_pair_find(fr_request, list(l), da, 0)\n"
+	"	return function()\n"
+	"		if vp == nil then return nil end\n"
+	"		local cur = vp\n"
+	"		vp = lib.fr_lua_pair_next(vp, da)\n"
+	"		return ffi.string(lib.fr_lua_pair_name(cur)), value(cur)\n"
+	"	end\n"
+	"end\n";
+
 /** Insert cdefs into the lua environment
  *
  * For LuaJIT using the FFI is significantly faster than the Lua interface.
@@ -130,6 +213,16 @@ static int _aux_log_error(lua_State *L)
  */
 int aux_jit_funcs_register(rlm_lua_t const *inst, lua_State *L)
 {
+	/*
+	 *	Must be registered first, as the functions below
+	 *	replace the global error() function.
+	 */
+	if (luaL_dostring(L, aux_jit_pair_funcs) != 0) {
+		ERROR("rlm_lua (%s): Failed setting up FFI pair functions: %s", inst->xlat_name,
+		      lua_gettop(L) ? lua_tostring(L, -1) : "Unknown error");
+		return -1;
+	}
+
 	if (luaL_dostring(L,"\
 		ffi = require(\"ffi\")\
 		ffi.cdef [[\
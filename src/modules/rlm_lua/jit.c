@@ -0,0 +1,400 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file jit.c
+ * @brief Attribute access functions for LuaJIT's FFI.
+ *
+ * These are called directly from Lua code compiled by LuaJIT, so they
+ * don't touch the Lua stack, and only take and return simple C types.
+ * The Lua wrappers which call them are registered by aux_jit_funcs_register.
+ *
+ * Lists are numbered 0 to 3, for request, reply, control and state.
+ * Instances of an attribute are numbered from 0.
+ *
+ * @copyright 2026 The FreeRADIUS Server Project.
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+
+#include "config.h"
+#include "lua.h"
+
+/** Value kinds returned by fr_lua_pair_kind
+ *
+ */
+enum {
+	FR_LUA_KIND_INTEGER = 0,			//!< Read with fr_lua_pair_get_int.
+	FR_LUA_KIND_NUMBER,				//!< Read with fr_lua_pair_get_number.
+	FR_LUA_KIND_STRING,				//!< Read with fr_lua_pair_get_string.
+	FR_LUA_KIND_OTHER				//!< Read with fr_lua_pair_print.
+};
+
+static pair_lists_t const fr_lua_lists[] = {
+	PAIR_LIST_REQUEST,
+	PAIR_LIST_REPLY,
+	PAIR_LIST_CONTROL,
+	PAIR_LIST_STATE
+};
+
+static VALUE_PAIR **fr_lua_list_head(REQUEST *request, int list)
+{
+	if (!request || (list < 0) || ((size_t)list >= (sizeof(fr_lua_lists) / sizeof(*fr_lua_lists)))) return NULL;
+
+	return radius_list(request, fr_lua_lists[list]);
+}
+
+/** Find the dictionary attribute with the given name
+ *
+ * The Lua wrappers cache the result, so this is only called once
+ * for each attribute name.
+ */
+fr_dict_attr_t const *fr_lua_attr_by_name(char const *name)
+{
+	return fr_dict_attr_by_name(NULL, name);
+}
+
+/** Find an instance of an attribute
+ *
+ * @param[in] request	The current request.
+ * @param[in] list	to search.
+ * @param[in] da	to find.  NULL matches any attribute.
+ * @param[in] index	of the instance to find.
+ * @return
+ *	- The attribute.
+ *	- NULL if there's no such instance.
+ */
+VALUE_PAIR *fr_lua_pair_find(REQUEST *request, int list, fr_dict_attr_t const *da, int index)
+{
+	VALUE_PAIR **head, *vp;
+
+	head = fr_lua_list_head(request, list);
+	if (!head) return NULL;
+
+	for (vp = *head; vp; vp = vp->next) {
+		if (da && (vp->da != da)) continue;
+		if (index-- == 0) return vp;
+	}
+
+	return NULL;
+}
+
+/** Find the next instance of an attribute after vp
+ *
+ * @param[in] vp	to start after.
+ * @param[in] da	to find.  NULL matches any attribute.
+ * @return
+ *	- The next instance.
+ *	- NULL if there are no more.
+ */
+VALUE_PAIR *fr_lua_pair_next(VALUE_PAIR *vp, fr_dict_attr_t const *da)
+{
+	for (vp = vp->next; vp; vp = vp->next) {
+		if (!da || (vp->da == da)) return vp;
+	}
+
+	return NULL;
+}
+
+char const *fr_lua_pair_name(VALUE_PAIR const *vp)
+{
+	return vp->da->name;
+}
+
+/** How the value of vp should be read
+ *
+ */
+int fr_lua_pair_kind(VALUE_PAIR const *vp)
+{
+	switch (vp->vp_type) {
+	case FR_TYPE_BOOL:
+	case FR_TYPE_UINT8:
+	case FR_TYPE_UINT16:
+	case FR_TYPE_UINT32:
+	case FR_TYPE_UINT64:
+	case FR_TYPE_INT8:
+	case FR_TYPE_INT16:
+	case FR_TYPE_INT32:
+	case FR_TYPE_INT64:
+	case FR_TYPE_DATE:
+	case FR_TYPE_DATE_MILLISECONDS:
+	case FR_TYPE_DATE_MICROSECONDS:
+	case FR_TYPE_DATE_NANOSECONDS:
+		return FR_LUA_KIND_INTEGER;
+
+	case FR_TYPE_FLOAT32:
+	case FR_TYPE_FLOAT64:
+	case FR_TYPE_SIZE:
+		return FR_LUA_KIND_NUMBER;
+
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+		return FR_LUA_KIND_STRING;
+
+	default:
+		return FR_LUA_KIND_OTHER;
+	}
+}
+
+int64_t fr_lua_pair_get_int(VALUE_PAIR const *vp)
+{
+	switch (vp->vp_type) {
+	case FR_TYPE_BOOL:
+		return vp->vp_bool ? 1 : 0;
+
+	case FR_TYPE_UINT8:
+		return vp->vp_uint8;
+
+	case FR_TYPE_UINT16:
+		return vp->vp_uint16;
+
+	case FR_TYPE_UINT32:
+		return vp->vp_uint32;
+
+	case FR_TYPE_UINT64:
+		return (int64_t)vp->vp_uint64;
+
+	case FR_TYPE_INT8:
+		return vp->vp_int8;
+
+	case FR_TYPE_INT16:
+		return vp->vp_int16;
+
+	case FR_TYPE_INT32:
+		return vp->vp_int32;
+
+	case FR_TYPE_INT64:
+		return vp->vp_int64;
+
+	case FR_TYPE_DATE:
+		return vp->vp_date;
+
+	case FR_TYPE_DATE_MILLISECONDS:
+		return vp->vp_date_milliseconds;
+
+	case FR_TYPE_DATE_MICROSECONDS:
+		return vp->vp_date_microseconds;
+
+	case FR_TYPE_DATE_NANOSECONDS:
+		return vp->vp_date_nanoseconds;
+
+	default:
+		return 0;
+	}
+}
+
+double fr_lua_pair_get_number(VALUE_PAIR const *vp)
+{
+	switch (vp->vp_type) {
+	case FR_TYPE_FLOAT32:
+		return vp->vp_float32;
+
+	case FR_TYPE_FLOAT64:
+		return vp->vp_float64;
+
+	case FR_TYPE_SIZE:
+		return vp->vp_size;
+
+	default:
+		return (double)fr_lua_pair_get_int(vp);
+	}
+}
+
+/** Return a pointer to the value of a string or octets attribute
+ *
+ * The value isn't copied.  The pointer is valid until the attribute is
+ * changed or freed.
+ *
+ * @param[in] vp	to read.
+ * @param[out] out	Where to write a pointer to the value.
+ * @return the length of the value.
+ */
+size_t fr_lua_pair_get_string(VALUE_PAIR const *vp, char const **out)
+{
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+		*out = vp->vp_strvalue;
+		return vp->vp_length;
+
+	case FR_TYPE_OCTETS:
+		*out = (char const *)vp->vp_octets;
+		return vp->vp_length;
+
+	default:
+		*out = "";
+		return 0;
+	}
+}
+
+/** Print the value of an attribute of any type
+ *
+ * @return the length of the printed value.
+ */
+size_t fr_lua_pair_print(VALUE_PAIR const *vp, char *out, size_t outlen)
+{
+	size_t len;
+
+	len = fr_pair_value_snprint(out, outlen, vp, '\0');
+	if (len >= outlen) len = outlen - 1;
+
+	return len;
+}
+
+/** Find an instance of an attribute to write to, creating it if there isn't one
+ *
+ */
+static VALUE_PAIR *fr_lua_pair_find_or_add(REQUEST *request, int list, fr_dict_attr_t const *da, int index)
+{
+	VALUE_PAIR	**head, *vp;
+	TALLOC_CTX	*ctx;
+
+	vp = fr_lua_pair_find(request, list, da, index);
+	if (vp) {
+		/*
+		 *	The value is about to change, so any
+		 *	pre-encoded form is stale.
+		 */
+		vp->encoded = NULL;
+		return vp;
+	}
+
+	head = fr_lua_list_head(request, list);
+	if (!head) return NULL;
+
+	ctx = radius_list_ctx(request, fr_lua_lists[list]);
+	if (!ctx) return NULL;
+
+	vp = fr_pair_afrom_da(ctx, da);
+	if (!vp) return NULL;
+
+	fr_pair_add(head, vp);
+
+	return vp;
+}
+
+/** Set an attribute from a Lua number
+ *
+ * Integer types are written directly.  Other types are printed, and
+ * parsed as the type of the attribute.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_lua_pair_set_number(REQUEST *request, int list, fr_dict_attr_t const *da, int index, double value)
+{
+	VALUE_PAIR	*vp;
+	char		buffer[64];
+
+	vp = fr_lua_pair_find_or_add(request, list, da, index);
+	if (!vp) return -1;
+
+	switch (vp->vp_type) {
+	case FR_TYPE_BOOL:
+		vp->vp_bool = (value != 0);
+		return 0;
+
+	case FR_TYPE_UINT8:
+		if ((value < 0) || (value > UINT8_MAX)) goto overflow;
+		vp->vp_uint8 = value;
+		return 0;
+
+	case FR_TYPE_UINT16:
+		if ((value < 0) || (value > UINT16_MAX)) goto overflow;
+		vp->vp_uint16 = value;
+		return 0;
+
+	case FR_TYPE_UINT32:
+		if ((value < 0) || (value > UINT32_MAX)) goto overflow;
+		vp->vp_uint32 = value;
+		return 0;
+
+	case FR_TYPE_INT32:
+		if ((value < INT32_MIN) || (value > INT32_MAX)) goto overflow;
+		vp->vp_int32 = value;
+		return 0;
+
+	case FR_TYPE_FLOAT64:
+		vp->vp_float64 = value;
+		return 0;
+
+	default:
+		break;
+	}
+
+	if (value == (double)(int64_t)value) {
+		snprintf(buffer, sizeof(buffer), "%" PRId64, (int64_t)value);
+	} else {
+		snprintf(buffer, sizeof(buffer), "%f", value);
+	}
+
+	return fr_pair_value_from_str(vp, buffer, -1);
+
+overflow:
+	fr_strerror_printf("Value %f out of range for %s", value, da->name);
+	return -1;
+}
+
+/** Set an attribute from a Lua string
+ *
+ * Octets are copied as is.  Other types are parsed.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_lua_pair_set_string(REQUEST *request, int list, fr_dict_attr_t const *da, int index,
+			   char const *value, size_t len)
+{
+	VALUE_PAIR *vp;
+
+	vp = fr_lua_pair_find_or_add(request, list, da, index);
+	if (!vp) return -1;
+
+	if (vp->vp_type == FR_TYPE_OCTETS) {
+		fr_pair_value_memcpy(vp, (uint8_t const *)value, len);
+		return 0;
+	}
+
+	return fr_pair_value_from_str(vp, value, len);
+}
+
+/** Delete an instance of an attribute
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if there's no such instance.
+ */
+int fr_lua_pair_delete(REQUEST *request, int list, fr_dict_attr_t const *da, int index)
+{
+	VALUE_PAIR **head, **last, *vp;
+
+	head = fr_lua_list_head(request, list);
+	if (!head) return -1;
+
+	for (last = head; (vp = *last) != NULL; last = &vp->next) {
+		if (vp->da != da) continue;
+		if (index-- > 0) continue;
+
+		*last = vp->next;
+		talloc_free(vp);
+
+		return 0;
+	}
+
+	return -1;
+}
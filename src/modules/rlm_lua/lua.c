@@ -722,7 +722,11 @@ int rlm_lua_init(lua_State **out, rlm_lua_t const *instance)
 		goto error;
 	}
 
-	if (inst->jit) {
+	/*
+	 *	Check the interpreter rather than inst->jit, which
+	 *	isn't set until the first interpreter is created.
+	 */
+	if (rlm_lua_isjit(L)) {
 		DEBUG4("rlm_lua (%s): Initialised new LuaJIT interpreter %p", inst->xlat_name, L);
 		aux_jit_funcs_register(inst, L);
 	} else {
@@ -799,19 +803,10 @@ static int rlm_lua_get_field(lua_State *L, REQUEST *request, char const *field)
 	return 0;
 }
 
-static int _lua_state_free(lua_State **marker)
-{
-	lua_close(*((lua_State **) marker));
-	return 0;
-}
-
 /** Get a lua interpreter to use
  *
  */
-static lua_State *rlm_lua_get_interp(rlm_lua_t const *inst) {
-	lua_State **marker;
-	lua_State *L;
-
+static lua_State *rlm_lua_get_interp(rlm_lua_t const *inst, rlm_lua_thread_t *thread) {
 #ifdef HAVE_PTHREAD_H
 	/*
 	 *	Were running in single interpreter mode, grab the interpreter lock
@@ -825,23 +820,11 @@ static lua_State *rlm_lua_get_interp(rlm_lua_t const *inst) {
 	}
 
 	/*
-	 *	Were running in multi interpreter mode, retrieve or initialise
-	 *	the thread specific, instance specific interpreter.
+	 *	Were running in multi interpreter mode, use the thread
+	 *	specific, instance specific interpreter.  It was created
+	 *	when the thread was instantiated.
 	 */
-	marker = pthread_getspecific(inst->key);
-	if (!marker) {
-		if (rlm_lua_init(&L, inst) < 0) {
-			return NULL;
-		}
-		marker = talloc(inst, lua_State *);
-		talloc_set_destructor(marker, _lua_state_free);
-		*marker = L;
-		(void) pthread_setspecific(inst->key, marker);
-
-		return L;
-	}
-
-	return *talloc_get_type_abort(marker, lua_State *);
+	return thread->interpreter;
 #else
 	/*
 	 *	We were build without threads, so inst->threads has no effect.
@@ -857,14 +840,14 @@ static lua_State *rlm_lua_get_interp(rlm_lua_t const *inst) {
 #define rlm_lua_release_interp(_x)
 #endif
 
-int do_lua(rlm_lua_t const *inst, REQUEST *request, char const *funcname)
+int do_lua(rlm_lua_t const *inst, rlm_lua_thread_t *thread, REQUEST *request, char const *funcname)
 {
 	vp_cursor_t cursor;
 	lua_State *L;
 
 	rlm_lua_request = request;
 
-	L = rlm_lua_get_interp(inst);
+	L = rlm_lua_get_interp(inst, thread);
 	if (!L) return -1;
 
 	RDEBUG2("Calling %s() in interpreter %p", funcname, L);
@@ -872,6 +855,14 @@ int do_lua(rlm_lua_t const *inst, REQUEST *request, char const *funcname)
 	fr_pair_list_sort(&request->packet->vps, fr_pair_cmp_by_da_tag);
 	fr_pair_cursor_init(&cursor, &request->packet->vps);
 
+	/*
+	 *	Used by the FFI pair functions
+	 */
+	if (inst->jit) {
+		lua_pushlightuserdata(L, request);
+		lua_setglobal(L, "fr_request");
+	}
+
 	/*
 	 *	Setup the environment
 	 */
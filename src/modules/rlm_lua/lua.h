@@ -51,7 +51,6 @@ typedef struct rlm_lua {
 						//!< basis, or use a single mutex protected interpreter.
 
 #ifdef HAVE_PTHREAD_H
-	pthread_key_t	key;			//!< Key to access the thread local and instance specific interpreter.
 	pthread_mutex_t	*mutex;			//!< Mutex used to protect interpreter, when running with a single
 						//!< interpreter (threads = no).
 #endif
@@ -81,9 +80,13 @@ typedef struct rlm_lua {
 	const char	*func_xlat;		//!< Name of function to be called for string expansions.
 } rlm_lua_t;
 
+typedef struct rlm_lua_thread {
+	lua_State	*interpreter;		//!< Thread specific interpreter, when running with threads = yes.
+} rlm_lua_thread_t;
+
 /* lua.c */
 int rlm_lua_init(lua_State **out, rlm_lua_t const *instance);
-int do_lua(rlm_lua_t const *inst, REQUEST *request, char const *funcname);
+int do_lua(rlm_lua_t const *inst, rlm_lua_thread_t *thread, REQUEST *request, char const *funcname);
 bool rlm_lua_isjit(lua_State *L);
 char const *rlm_lua_version(lua_State *L);
 
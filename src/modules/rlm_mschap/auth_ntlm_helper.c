@@ -0,0 +1,753 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file auth_ntlm_helper.c
+ * @brief NTLM authentication via persistent ntlm_auth helper processes
+ *
+ * Each worker thread runs a small pool of ntlm_auth processes in
+ * "--helper-protocol=ntlm-server-1" mode.  Requests are written to a
+ * helper's stdin, and the helper's stdout is serviced by the worker's
+ * event loop, so the request yields whilst the domain controller
+ * is consulted, rather than blocking the worker.
+ *
+ * Each helper processes one request at a time.  Requests which arrive
+ * when all of a thread's helpers are busy are queued, and dispatched
+ * as helpers become free.
+ *
+ * The number of requests in flight for each domain is limited across
+ * all threads, to stop a slow domain controller consuming every helper.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/base64.h>
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "rlm_mschap.h"
+#include "mschap.h"
+#include "auth_ntlm_helper.h"
+
+#define NT_LENGTH 24
+
+/** Requests in flight for a domain
+ *
+ */
+typedef struct {
+	char const		*name;			//!< Domain name.
+	uint32_t		outstanding;		//!< Requests sent to helpers, and not yet answered.
+} mschap_helper_domain_t;
+
+struct mschap_helper_limits {
+	pthread_mutex_t		mutex;			//!< Protects the tree, and counters.
+	rbtree_t		*tree;			//!< Domains we've seen requests for.
+};
+
+typedef struct mschap_helper mschap_helper_t;
+
+/** An ntlm_auth process
+ *
+ */
+struct mschap_helper {
+	mschap_helper_pool_t	*pool;			//!< Pool this helper belongs to.
+
+	pid_t			pid;			//!< Of the helper, or -1 if not running.
+	int			to_child;		//!< Helper's stdin.
+	int			from_child;		//!< Helper's stdout.
+
+	char			buff[1024];		//!< Partial response.
+	size_t			used;			//!< Bytes of buff used.
+
+	uint32_t		requests;		//!< Requests processed by this process.
+
+	mschap_helper_req_t	*req;			//!< Request the helper is processing.
+	fr_event_timer_t const	*ev;			//!< Timeout for the current request.
+};
+
+struct mschap_helper_pool {
+	rlm_mschap_t const	*inst;			//!< Instance of rlm_mschap.
+	fr_event_list_t		*el;			//!< Event list servicing the helpers.
+
+	mschap_helper_t		**helpers;		//!< Array of helpers.
+
+	mschap_helper_req_t	*head;			//!< First request waiting for a helper.
+	mschap_helper_req_t	**tail;			//!< Where to add the next waiting request.
+};
+
+struct mschap_helper_req {
+	mschap_helper_pool_t	*pool;			//!< Pool the request was submitted to.
+	REQUEST			*request;		//!< Request to resume, or NULL if it was cancelled.
+
+	char			*msg;			//!< To write to the helper.
+	mschap_helper_domain_t	*domain;		//!< Request counts against, or NULL if unlimited.
+
+	bool			queued;			//!< Waiting for a helper.
+	mschap_helper_req_t	*next;			//!< Next request waiting for a helper.
+	mschap_helper_t		*helper;		//!< Processing the request.
+
+	int			result;			//!< As returned by do_mschap().
+	uint8_t			nthashhash[NT_DIGEST_LENGTH];	//!< From the User-Session-Key.
+	char const		*error;			//!< Error from the helper, or about the helper.
+};
+
+static void helper_dispatch(mschap_helper_pool_t *pool);
+
+static int helper_domain_cmp(void const *a, void const *b)
+{
+	mschap_helper_domain_t const *my_a = a, *my_b = b;
+
+	return strcmp(my_a->name, my_b->name);
+}
+
+/** Allocate the per-domain request counters
+ *
+ * @param[in] inst	of rlm_mschap.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int mschap_helper_limits_init(rlm_mschap_t *inst)
+{
+	mschap_helper_limits_t *limits;
+
+	MEM(limits = talloc_zero(inst, mschap_helper_limits_t));
+	limits->tree = rbtree_create(limits, helper_domain_cmp, NULL, 0);
+	if (!limits->tree) {
+		talloc_free(limits);
+		return -1;
+	}
+	pthread_mutex_init(&limits->mutex, NULL);
+
+	inst->helper.limits = limits;
+
+	return 0;
+}
+
+/** Count a request against its domain's limit
+ *
+ * @return
+ *	- 0 if the request may be sent.
+ *	- -1 if too many requests are in flight for the domain.
+ */
+static int helper_domain_acquire(mschap_helper_domain_t **out, rlm_mschap_t const *inst, char const *name)
+{
+	mschap_helper_limits_t	*limits = inst->helper.limits;
+	mschap_helper_domain_t	find, *domain;
+
+	*out = NULL;
+
+	if (!inst->helper.max_outstanding) return 0;
+
+	find.name = name;
+
+	pthread_mutex_lock(&limits->mutex);
+	domain = rbtree_finddata(limits->tree, &find);
+	if (!domain) {
+		MEM(domain = talloc_zero(limits, mschap_helper_domain_t));
+		domain->name = talloc_typed_strdup(domain, name);
+		if (!rbtree_insert(limits->tree, domain)) {
+			pthread_mutex_unlock(&limits->mutex);
+			talloc_free(domain);
+			return -1;
+		}
+	}
+
+	if (domain->outstanding >= inst->helper.max_outstanding) {
+		pthread_mutex_unlock(&limits->mutex);
+		return -1;
+	}
+	domain->outstanding++;
+	pthread_mutex_unlock(&limits->mutex);
+
+	*out = domain;
+
+	return 0;
+}
+
+static void helper_domain_release(rlm_mschap_t const *inst, mschap_helper_domain_t *domain)
+{
+	mschap_helper_limits_t *limits = inst->helper.limits;
+
+	if (!domain) return;
+
+	pthread_mutex_lock(&limits->mutex);
+	rad_assert(domain->outstanding > 0);
+	domain->outstanding--;
+	pthread_mutex_unlock(&limits->mutex);
+}
+
+/** Record the result of a request, and resume it
+ *
+ * If the request was cancelled, there's nothing to resume, and the
+ * helper request is freed.
+ */
+static void helper_req_complete(mschap_helper_req_t *hreq, int result, char const *error)
+{
+	rlm_mschap_t const *inst = hreq->pool->inst;
+
+	hreq->result = result;
+	if (error) hreq->error = talloc_typed_strdup(hreq, error);
+	hreq->helper = NULL;
+
+	helper_domain_release(inst, hreq->domain);
+	hreq->domain = NULL;
+
+	if (!hreq->request) {
+		talloc_free(hreq);
+		return;
+	}
+
+	unlang_resumable(hreq->request);
+}
+
+/** Stop a helper process
+ *
+ * Any request the helper was processing is failed.
+ */
+static void helper_stop(mschap_helper_t *helper, char const *error)
+{
+	int status;
+
+	if (helper->ev) fr_event_timer_delete(helper->pool->el, &helper->ev);
+
+	if (helper->from_child >= 0) {
+		fr_event_fd_delete(helper->pool->el, helper->from_child);
+		close(helper->from_child);
+		helper->from_child = -1;
+	}
+
+	if (helper->to_child >= 0) {
+		close(helper->to_child);
+		helper->to_child = -1;
+	}
+
+	if (helper->pid > 0) {
+		kill(helper->pid, SIGTERM);
+		rad_waitpid(helper->pid, &status);
+		helper->pid = -1;
+	}
+
+	helper->used = 0;
+	helper->requests = 0;
+
+	if (helper->req) {
+		mschap_helper_req_t *hreq = helper->req;
+
+		helper->req = NULL;
+		helper_req_complete(hreq, -1, error);
+	}
+}
+
+/** Map an Authentication-Error to a do_mschap() result
+ *
+ * ntlm_auth reports either the NT_STATUS name, or a human readable string.
+ */
+static int helper_error_to_result(char const *error)
+{
+	if (strcasestr(error, "Password expired") ||
+	    strcasestr(error, "Must change password") ||
+	    strcasestr(error, "NT_STATUS_PASSWORD_EXPIRED") ||
+	    strcasestr(error, "NT_STATUS_PASSWORD_MUST_CHANGE")) return -648;
+
+	if (strcasestr(error, "Account locked out") ||
+	    strcasestr(error, "NT_STATUS_ACCOUNT_LOCKED_OUT") ||
+	    strcasestr(error, "0xC0000234")) return -647;
+
+	if (strcasestr(error, "Account disabled") ||
+	    strcasestr(error, "NT_STATUS_ACCOUNT_DISABLED") ||
+	    strcasestr(error, "0xC0000072")) return -691;
+
+	return -1;
+}
+
+/** Parse a complete response from a helper
+ *
+ * The response is a series of "Key: Value" lines, terminated by a line
+ * containing a single ".".  Values may instead be base64 encoded, in which
+ * case the separator is "::".
+ */
+static void helper_response_process(mschap_helper_req_t *hreq, char *response)
+{
+	char		*line, *next, *value;
+	bool		authenticated = false, have_key = false;
+	char		error[256] = "No Authentication-Error from ntlm_auth";
+	uint8_t		key[NT_DIGEST_LENGTH];
+
+	for (line = response; line && (line[0] != '.'); line = next) {
+		next = strchr(line, '\n');
+		if (next) *next++ = '\0';
+
+		value = strchr(line, ':');
+		if (!value) continue;
+		*value++ = '\0';
+
+		/*
+		 *	Base64 encoded values are only used
+		 *	for error strings that contain
+		 *	characters which can't be sent as-is.
+		 */
+		if (*value == ':') {
+			ssize_t slen;
+
+			value++;
+			while (*value == ' ') value++;
+
+			slen = fr_base64_decode((uint8_t *)error, sizeof(error) - 1, value, strlen(value));
+			if (slen < 0) continue;
+			error[slen] = '\0';
+			continue;
+		}
+		while (*value == ' ') value++;
+
+		if (strcasecmp(line, "Authenticated") == 0) {
+			authenticated = (strcasecmp(value, "Yes") == 0);
+
+		} else if (strcasecmp(line, "User-Session-Key") == 0) {
+			have_key = (fr_hex2bin(key, sizeof(key), value, strlen(value)) == sizeof(key));
+
+		} else if ((strcasecmp(line, "Authentication-Error") == 0) || (strcasecmp(line, "Error") == 0)) {
+			strlcpy(error, value, sizeof(error));
+		}
+	}
+
+	if (!authenticated) {
+		helper_req_complete(hreq, helper_error_to_result(error), error);
+		return;
+	}
+
+	if (!have_key) {
+		helper_req_complete(hreq, -1, "Invalid output from ntlm_auth: missing or invalid User-Session-Key");
+		return;
+	}
+
+	memcpy(hreq->nthashhash, key, sizeof(hreq->nthashhash));
+	helper_req_complete(hreq, 0, NULL);
+}
+
+/** Read a response from a helper
+ *
+ */
+static void _helper_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	mschap_helper_t		*helper = talloc_get_type_abort(uctx, mschap_helper_t);
+	mschap_helper_pool_t	*pool = helper->pool;
+	rlm_mschap_t const	*inst = pool->inst;
+	ssize_t			slen;
+	char			*end;
+
+	slen = read(helper->from_child, helper->buff + helper->used, sizeof(helper->buff) - helper->used - 1);
+	if (slen < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR)) return;
+
+		ERROR("%s: Failed reading from ntlm_auth helper: %s", inst->xlat_name, fr_syserror(errno));
+		helper_stop(helper, "Failed reading from ntlm_auth helper");
+		helper_dispatch(pool);
+		return;
+	}
+
+	if (slen == 0) {
+		ERROR("%s: ntlm_auth helper exited", inst->xlat_name);
+		helper_stop(helper, "ntlm_auth helper exited");
+		helper_dispatch(pool);
+		return;
+	}
+
+	helper->used += slen;
+	helper->buff[helper->used] = '\0';
+
+	/*
+	 *	Wait for the terminating "."
+	 */
+	if ((helper->buff[0] == '.') && (helper->buff[1] == '\n')) {
+		end = helper->buff;
+	} else {
+		end = strstr(helper->buff, "\n.\n");
+		if (end) end++;
+	}
+
+	if (!end) {
+		if (helper->used >= (sizeof(helper->buff) - 1)) {
+			ERROR("%s: Response from ntlm_auth helper too long", inst->xlat_name);
+			helper_stop(helper, "Response from ntlm_auth helper too long");
+			helper_dispatch(pool);
+		}
+		return;
+	}
+
+	if (!helper->req) {
+		ERROR("%s: Unsolicited response from ntlm_auth helper", inst->xlat_name);
+		helper_stop(helper, NULL);
+		helper_dispatch(pool);
+		return;
+	}
+
+	if (helper->ev) fr_event_timer_delete(pool->el, &helper->ev);
+
+	{
+		mschap_helper_req_t *hreq = helper->req;
+
+		helper->req = NULL;
+		helper->used = 0;
+		helper_response_process(hreq, helper->buff);
+	}
+
+	/*
+	 *	Recycle helpers periodically, in case they leak
+	 */
+	if (inst->helper.max_requests && (++helper->requests >= inst->helper.max_requests)) {
+		DEBUG2("%s: ntlm_auth helper %u has processed %u requests, restarting", inst->xlat_name,
+		       (unsigned int)helper->pid, helper->requests);
+		helper_stop(helper, NULL);
+	}
+
+	helper_dispatch(pool);
+}
+
+static void _helper_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	mschap_helper_t		*helper = talloc_get_type_abort(uctx, mschap_helper_t);
+	mschap_helper_pool_t	*pool = helper->pool;
+
+	ERROR("%s: Error on ntlm_auth helper pipe: %s", pool->inst->xlat_name, fr_syserror(fd_errno));
+	helper_stop(helper, "Error on ntlm_auth helper pipe");
+	helper_dispatch(pool);
+}
+
+/** The helper took too long to respond, kill it
+ *
+ */
+static void _helper_timeout(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	mschap_helper_t		*helper = talloc_get_type_abort(uctx, mschap_helper_t);
+	mschap_helper_pool_t	*pool = helper->pool;
+
+	helper->ev = NULL;
+
+	ERROR("%s: ntlm_auth helper %u timed out", pool->inst->xlat_name, (unsigned int)helper->pid);
+	helper_stop(helper, "ntlm_auth helper timed out");
+	helper_dispatch(pool);
+}
+
+/** Start a helper process
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int helper_start(mschap_helper_t *helper)
+{
+	mschap_helper_pool_t	*pool = helper->pool;
+	rlm_mschap_t const	*inst = pool->inst;
+
+	helper->pid = radius_start_program(inst->helper.program, NULL, true,
+					   &helper->to_child, &helper->from_child, NULL, false);
+	if (helper->pid < 0) {
+		ERROR("%s: Failed starting ntlm_auth helper", inst->xlat_name);
+		helper->pid = -1;
+		helper->to_child = helper->from_child = -1;
+		return -1;
+	}
+
+	fr_nonblock(helper->from_child);
+
+	if (fr_event_fd_insert(helper, pool->el, helper->from_child,
+			       _helper_read, NULL, _helper_error, helper) < 0) {
+		ERROR("%s: Failed inserting ntlm_auth helper into event loop: %s", inst->xlat_name, fr_strerror());
+		helper_stop(helper, NULL);
+		return -1;
+	}
+
+	DEBUG2("%s: Started ntlm_auth helper %u", inst->xlat_name, (unsigned int)helper->pid);
+
+	return 0;
+}
+
+/** Send a request to a helper
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The request has been completed.
+ */
+static int helper_send(mschap_helper_t *helper, mschap_helper_req_t *hreq)
+{
+	mschap_helper_pool_t	*pool = helper->pool;
+	rlm_mschap_t const	*inst = pool->inst;
+	char const		*p = hreq->msg, *end = hreq->msg + talloc_array_length(hreq->msg) - 1;
+	struct timeval		when;
+
+	if ((helper->pid < 0) && (helper_start(helper) < 0)) {
+		helper_req_complete(hreq, -1, "Failed starting ntlm_auth helper");
+		return -1;
+	}
+
+	/*
+	 *	Requests are a few hundred bytes, much less
+	 *	than the pipe buffer, so this won't block.
+	 */
+	while (p < end) {
+		ssize_t slen;
+
+		slen = write(helper->to_child, p, end - p);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+
+			ERROR("%s: Failed writing to ntlm_auth helper: %s", inst->xlat_name, fr_syserror(errno));
+			helper_stop(helper, NULL);
+			helper_req_complete(hreq, -1, "Failed writing to ntlm_auth helper");
+			return -1;
+		}
+		p += slen;
+	}
+
+	hreq->helper = helper;
+	helper->req = hreq;
+
+	gettimeofday(&when, NULL);
+	when.tv_sec += inst->ntlm_auth_timeout;
+	if (fr_event_timer_insert(helper, pool->el, &helper->ev, &when, _helper_timeout, helper) < 0) {
+		ERROR("%s: Failed inserting ntlm_auth helper timeout: %s", inst->xlat_name, fr_strerror());
+	}
+
+	return 0;
+}
+
+/** Send waiting requests to idle helpers
+ *
+ */
+static void helper_dispatch(mschap_helper_pool_t *pool)
+{
+	size_t i;
+
+	for (i = 0; (i < talloc_array_length(pool->helpers)) && pool->head; i++) {
+		mschap_helper_t		*helper = pool->helpers[i];
+		mschap_helper_req_t	*hreq;
+
+		if (helper->req) continue;
+
+		hreq = pool->head;
+		pool->head = hreq->next;
+		if (!pool->head) pool->tail = &pool->head;
+		hreq->next = NULL;
+		hreq->queued = false;
+
+		/*
+		 *	If the helper couldn't be started, or
+		 *	died, try the next request on the same
+		 *	helper.
+		 */
+		if (helper_send(helper, hreq) < 0) i--;
+	}
+}
+
+static int _helper_pool_free(mschap_helper_pool_t *pool)
+{
+	mschap_helper_req_t	*hreq, *next;
+	size_t			i;
+
+	for (i = 0; i < talloc_array_length(pool->helpers); i++) helper_stop(pool->helpers[i], "Module is exiting");
+
+	for (hreq = pool->head; hreq; hreq = next) {
+		next = hreq->next;
+		hreq->queued = false;
+		helper_req_complete(hreq, -1, "Module is exiting");
+	}
+	pool->head = NULL;
+	pool->tail = &pool->head;
+
+	return 0;
+}
+
+/** Allocate a pool of ntlm_auth helpers for a worker thread
+ *
+ * Helpers are started when the first request is sent to them.
+ *
+ * @param[in] ctx	to allocate the pool in.
+ * @param[in] inst	of rlm_mschap.
+ * @param[in] el	Event list of the worker thread.
+ * @return
+ *	- A new helper pool.
+ *	- NULL on error.
+ */
+mschap_helper_pool_t *mschap_helper_pool_alloc(TALLOC_CTX *ctx, rlm_mschap_t const *inst, fr_event_list_t *el)
+{
+	mschap_helper_pool_t	*pool;
+	uint32_t		i;
+
+	MEM(pool = talloc_zero(ctx, mschap_helper_pool_t));
+	pool->inst = inst;
+	pool->el = el;
+	pool->tail = &pool->head;
+
+	MEM(pool->helpers = talloc_array(pool, mschap_helper_t *, inst->helper.num));
+	for (i = 0; i < inst->helper.num; i++) {
+		mschap_helper_t *helper;
+
+		MEM(helper = talloc_zero(pool->helpers, mschap_helper_t));
+		helper->pool = pool;
+		helper->pid = -1;
+		helper->to_child = -1;
+		helper->from_child = -1;
+
+		pool->helpers[i] = helper;
+	}
+	talloc_set_destructor(pool, _helper_pool_free);
+
+	return pool;
+}
+
+/** Submit an authentication request to a helper
+ *
+ * The request should yield.  It will be marked resumable when the helper
+ * responds, at which point #mschap_helper_result should be called.
+ *
+ * @param[in] pool	of helpers belonging to this thread.
+ * @param[in] request	The current request.
+ * @param[in] challenge	MS-CHAPv1 challenge, 8 bytes.
+ * @param[in] response	NT-Response, 24 bytes.
+ * @return
+ *	- A helper request on success.
+ *	- NULL on failure.
+ */
+mschap_helper_req_t *mschap_helper_auth(mschap_helper_pool_t *pool, REQUEST *request,
+					uint8_t const *challenge, uint8_t const *response)
+{
+	rlm_mschap_t const	*inst = pool->inst;
+	mschap_helper_req_t	*hreq;
+	char			user_name_buf[500], domain_name_buf[500];
+	char const		*user_name, *domain_name = "";
+	char			user_name_b64[FR_BASE64_ENC_LENGTH(sizeof(user_name_buf)) + 1];
+	char			domain_name_b64[FR_BASE64_ENC_LENGTH(sizeof(domain_name_buf)) + 1];
+	char			challenge_hex[(8 * 2) + 1];
+	char			response_hex[(NT_LENGTH * 2) + 1];
+	ssize_t			slen;
+
+	rad_assert(inst->wb_username);
+
+	slen = tmpl_expand(&user_name, user_name_buf, sizeof(user_name_buf), request, inst->wb_username, NULL, NULL);
+	if (slen < 0) {
+		REDEBUG2("Unable to expand winbind_username");
+		return NULL;
+	}
+
+	if (inst->wb_domain) {
+		slen = tmpl_expand(&domain_name, domain_name_buf, sizeof(domain_name_buf),
+				   request, inst->wb_domain, NULL, NULL);
+		if (slen < 0) {
+			REDEBUG2("Unable to expand winbind_domain");
+			return NULL;
+		}
+	} else {
+		RWDEBUG2("No domain specified; authentication may fail because of this");
+	}
+
+	MEM(hreq = talloc_zero(pool, mschap_helper_req_t));
+	hreq->pool = pool;
+	hreq->request = request;
+	hreq->result = -1;
+
+	if (helper_domain_acquire(&hreq->domain, inst, domain_name) < 0) {
+		REDEBUG("Too many requests in flight for domain \"%s\"", domain_name);
+		talloc_free(hreq);
+		return NULL;
+	}
+
+	fr_base64_encode(user_name_b64, sizeof(user_name_b64), (uint8_t const *)user_name, strlen(user_name));
+	fr_base64_encode(domain_name_b64, sizeof(domain_name_b64), (uint8_t const *)domain_name, strlen(domain_name));
+	fr_bin2hex(challenge_hex, challenge, 8);
+	fr_bin2hex(response_hex, response, NT_LENGTH);
+
+	RDEBUG2("Sending request for \"%s\" to ntlm_auth helper", user_name);
+
+	MEM(hreq->msg = talloc_typed_asprintf(hreq,
+					      "Username:: %s\n"
+					      "NT-Domain:: %s\n"
+					      "LANMAN-Challenge: %s\n"
+					      "NT-Response: %s\n"
+					      "Request-User-Session-Key: Yes\n"
+					      ".\n",
+					      user_name_b64, domain_name_b64, challenge_hex, response_hex));
+
+	hreq->queued = true;
+	*pool->tail = hreq;
+	pool->tail = &hreq->next;
+
+	helper_dispatch(pool);
+
+	return hreq;
+}
+
+/** Retrieve the result of a request sent to a helper
+ *
+ * The helper request is freed.
+ *
+ * @param[in] request		The current request.
+ * @param[in] hreq		as returned by #mschap_helper_auth.
+ * @param[out] nthashhash	The hash of the NT hash, for MPPE keys.
+ * @return as do_mschap().
+ */
+int mschap_helper_result(REQUEST *request, mschap_helper_req_t *hreq, uint8_t nthashhash[NT_DIGEST_LENGTH])
+{
+	int ret = hreq->result;
+
+	if (ret == 0) {
+		memcpy(nthashhash, hreq->nthashhash, NT_DIGEST_LENGTH);
+		RDEBUG2("ntlm_auth helper authenticated user");
+	} else if (hreq->error) {
+		REDEBUG2("%s", hreq->error);
+	}
+
+	talloc_free(hreq);
+
+	return ret;
+}
+
+/** Stop waiting for a helper to respond
+ *
+ * Requests which are waiting for a helper are freed immediately.  Requests
+ * which have been sent to a helper are freed when the helper responds, so
+ * that the helper doesn't get out of sync.
+ *
+ * @param[in] hreq	to cancel.
+ */
+void mschap_helper_cancel(mschap_helper_req_t *hreq)
+{
+	mschap_helper_pool_t	*pool = hreq->pool;
+	mschap_helper_req_t	**last;
+
+	hreq->request = NULL;
+
+	if (hreq->helper) return;
+
+	if (hreq->queued) {
+		for (last = &pool->head; *last; last = &(*last)->next) {
+			if (*last != hreq) continue;
+
+			*last = hreq->next;
+			if (!*last) pool->tail = last;
+			break;
+		}
+		helper_domain_release(pool->inst, hreq->domain);
+	}
+
+	talloc_free(hreq);
+}
@@ -0,0 +1,22 @@
+/* Copyright 2017 The FreeRADIUS server project */
+
+#ifndef _AUTH_NTLM_HELPER_H
+#define _AUTH_NTLM_HELPER_H
+
+RCSIDH(auth_ntlm_helper_h, "$Id$")
+
+typedef struct mschap_helper_req mschap_helper_req_t;
+
+int			mschap_helper_limits_init(rlm_mschap_t *inst);
+
+mschap_helper_pool_t	*mschap_helper_pool_alloc(TALLOC_CTX *ctx, rlm_mschap_t const *inst, fr_event_list_t *el);
+
+mschap_helper_req_t	*mschap_helper_auth(mschap_helper_pool_t *pool, REQUEST *request,
+					    uint8_t const *challenge, uint8_t const *response);
+
+int			mschap_helper_result(REQUEST *request, mschap_helper_req_t *hreq,
+					     uint8_t nthashhash[NT_DIGEST_LENGTH]);
+
+void			mschap_helper_cancel(mschap_helper_req_t *hreq);
+
+#endif /*_AUTH_NTLM_HELPER_H*/
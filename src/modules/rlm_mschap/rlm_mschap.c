@@ -36,6 +36,7 @@ RCSID("$Id$")
 #include "rlm_mschap.h"
 #include "mschap.h"
 #include "smbdes.h"
+#include "auth_ntlm_helper.h"
 
 #ifdef WITH_AUTH_WINBIND
 #include "auth_wbclient.h"
@@ -548,6 +549,20 @@ static const CONF_PARSER passchange_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER helper_config[] = {
+	{ FR_CONF_OFFSET("program", FR_TYPE_STRING, rlm_mschap_t, helper.program) },
+	{ FR_CONF_OFFSET("helpers", FR_TYPE_UINT32, rlm_mschap_t, helper.num), .dflt = "2" },
+	{ FR_CONF_OFFSET("max_requests", FR_TYPE_UINT32, rlm_mschap_t, helper.max_requests), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_outstanding", FR_TYPE_UINT32, rlm_mschap_t, helper.max_outstanding), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER nt_hash_cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_mschap_t, nt_cache.max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("lifetime", FR_TYPE_UINT32, rlm_mschap_t, nt_cache.lifetime), .dflt = "30" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	/*
 	 *	Cache the password by default.
@@ -559,6 +574,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("ntlm_auth", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_mschap_t, ntlm_auth) },
 	{ FR_CONF_OFFSET("ntlm_auth_timeout", FR_TYPE_UINT32, rlm_mschap_t, ntlm_auth_timeout) },
 	{ FR_CONF_POINTER("passchange", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) passchange_config },
+	{ FR_CONF_POINTER("ntlm_auth_helper", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) helper_config },
+	{ FR_CONF_POINTER("nt_hash_cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) nt_hash_cache_config },
 	{ FR_CONF_OFFSET("allow_retry", FR_TYPE_BOOL, rlm_mschap_t, allow_retry), .dflt = "yes" },
 	{ FR_CONF_OFFSET("retry_msg", FR_TYPE_STRING, rlm_mschap_t, retry_msg) },
 	{ FR_CONF_OFFSET("winbind_username", FR_TYPE_TMPL, rlm_mschap_t, wb_username) },
@@ -572,6 +589,160 @@ static const CONF_PARSER module_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+/** The NT hash of a Cleartext-Password
+ *
+ */
+typedef struct mschap_nt_cache_entry mschap_nt_cache_entry_t;
+struct mschap_nt_cache_entry {
+	uint8_t			key[SHA1_DIGEST_LENGTH];	//!< HMAC of the Cleartext-Password.
+	uint8_t			nt_hash[NT_DIGEST_LENGTH];	//!< MD4 of the UTF-16 password.
+	time_t			expires;			//!< When the entry should be removed.
+
+	mschap_nt_cache_entry_t	*prev;				//!< Previous (older) entry.
+	mschap_nt_cache_entry_t	*next;				//!< Next (newer) entry.
+};
+
+struct mschap_nt_cache {
+	pthread_mutex_t		mutex;				//!< Protects the tree and list.
+	rbtree_t		*tree;				//!< Entries indexed by key.
+
+	mschap_nt_cache_entry_t	*head;				//!< Oldest entry.
+	mschap_nt_cache_entry_t	*tail;				//!< Newest entry.
+
+	uint8_t			secret[32];			//!< HMAC key.  Generated at startup,
+								//!< and never leaves the process.
+};
+
+static int mschap_nt_cache_entry_cmp(void const *one, void const *two)
+{
+	mschap_nt_cache_entry_t const *a = one, *b = two;
+
+	return memcmp(a->key, b->key, sizeof(a->key));
+}
+
+static int _mschap_nt_cache_entry_free(mschap_nt_cache_entry_t *entry)
+{
+	memset(entry->nt_hash, 0, sizeof(entry->nt_hash));
+
+	return 0;
+}
+
+static int _mschap_nt_cache_free(mschap_nt_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+	memset(cache->secret, 0, sizeof(cache->secret));
+
+	return 0;
+}
+
+/** Unlink and free an entry
+ *
+ * Must be called with the mutex held.
+ */
+static void mschap_nt_cache_entry_free(mschap_nt_cache_t *cache, mschap_nt_cache_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+
+	rbtree_deletebydata(cache->tree, entry);
+	talloc_free(entry);
+}
+
+/** Remove expired entries
+ *
+ * Entries all have the same lifetime, so the list is in expiry order.
+ * Must be called with the mutex held.
+ */
+static void mschap_nt_cache_expire(mschap_nt_cache_t *cache, time_t now)
+{
+	while (cache->head && (cache->head->expires <= now)) mschap_nt_cache_entry_free(cache, cache->head);
+}
+
+/** Derive the NT hash of a Cleartext-Password, using the cache if possible
+ *
+ * PEAP-MSCHAPv2 and friends authenticate the same users over and over,
+ * so we remember the NT hash of each password for a short time.  Entries
+ * are keyed on an HMAC of the password, so a changed password is a
+ * different entry, and the cache can't be searched for a known password
+ * without the secret.
+ *
+ * @param[in] inst	Module instance.
+ * @param[out] nt_hash	Where to write the NT hash.
+ * @param[in] password	Cleartext-Password to hash.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mschap_nt_cache_hash(rlm_mschap_t const *inst, uint8_t nt_hash[NT_DIGEST_LENGTH],
+				VALUE_PAIR const *password)
+{
+	mschap_nt_cache_t	*cache = inst->nt_cache.cache;
+	mschap_nt_cache_entry_t	find, *entry;
+	time_t			now;
+
+	if (!cache) return mschap_ntpwdhash(nt_hash, password->vp_strvalue);
+
+	fr_hmac_sha1(find.key, password->vp_octets, password->vp_length, cache->secret, sizeof(cache->secret));
+
+	now = time(NULL);
+
+	pthread_mutex_lock(&cache->mutex);
+	mschap_nt_cache_expire(cache, now);
+	entry = rbtree_finddata(cache->tree, &find);
+	if (entry) {
+		memcpy(nt_hash, entry->nt_hash, NT_DIGEST_LENGTH);
+		pthread_mutex_unlock(&cache->mutex);
+		return 0;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (mschap_ntpwdhash(nt_hash, password->vp_strvalue) < 0) return -1;
+
+	pthread_mutex_lock(&cache->mutex);
+	while (cache->head && (rbtree_num_elements(cache->tree) >= inst->nt_cache.max_entries)) {
+		mschap_nt_cache_entry_free(cache, cache->head);
+	}
+
+	entry = talloc_zero(cache, mschap_nt_cache_entry_t);
+	if (!entry) {
+		pthread_mutex_unlock(&cache->mutex);
+		return 0;
+	}
+	talloc_set_destructor(entry, _mschap_nt_cache_entry_free);
+	memcpy(entry->key, find.key, sizeof(entry->key));
+	memcpy(entry->nt_hash, nt_hash, sizeof(entry->nt_hash));
+	entry->expires = now + inst->nt_cache.lifetime;
+
+	/*
+	 *	Another thread hashed the same
+	 *	password at the same time.
+	 */
+	if (!rbtree_insert(cache->tree, entry)) {
+		pthread_mutex_unlock(&cache->mutex);
+		talloc_free(entry);
+		return 0;
+	}
+
+	entry->prev = cache->tail;
+	if (cache->tail) {
+		cache->tail->next = entry;
+	} else {
+		cache->head = entry;
+	}
+	cache->tail = entry;
+	pthread_mutex_unlock(&cache->mutex);
+
+	return 0;
+}
 
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
@@ -611,7 +782,22 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	 */
 	inst->method = AUTH_INTERNAL;
 
-	if (inst->wb_username) {
+	if (inst->helper.program) {
+		if (!inst->wb_username) {
+			cf_log_err(conf, "'winbind_username' must be set to use 'ntlm_auth_helper'");
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("helpers", inst->helper.num, >=, 1);
+		FR_INTEGER_BOUND_CHECK("helpers", inst->helper.num, <=, 64);
+
+		if (mschap_helper_limits_init(inst) < 0) {
+			cf_log_err(conf, "Unable to initialise ntlm_auth helper limits");
+			return -1;
+		}
+
+		inst->method = AUTH_NTLMAUTH_HELPER;
+	} else if (inst->wb_username) {
 #ifdef WITH_AUTH_WINBIND
 		inst->method = AUTH_WBCLIENT;
 
@@ -638,6 +824,9 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	case AUTH_NTLMAUTH_EXEC:
 		DEBUG("%s : authenticating by calling 'ntlm_auth'", inst->xlat_name);
 		break;
+	case AUTH_NTLMAUTH_HELPER:
+		DEBUG("%s : authenticating via a pool of 'ntlm_auth' helpers", inst->xlat_name);
+		break;
 #ifdef WITH_AUTH_WINBIND
 	case AUTH_WBCLIENT:
 		DEBUG("%s : authenticating directly to winbind", inst->xlat_name);
@@ -662,6 +851,22 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->nt_cache.max_entries) {
+		FR_INTEGER_BOUND_CHECK("nt_hash_cache.lifetime", inst->nt_cache.lifetime, >=, 1);
+		FR_INTEGER_BOUND_CHECK("nt_hash_cache.lifetime", inst->nt_cache.lifetime, <=, 3600);
+
+		MEM(inst->nt_cache.cache = talloc_zero(inst, mschap_nt_cache_t));
+		inst->nt_cache.cache->tree = rbtree_create(inst->nt_cache.cache, mschap_nt_cache_entry_cmp, NULL, 0);
+		if (!inst->nt_cache.cache->tree) {
+			cf_log_err(conf, "Failed creating NT hash cache");
+			return -1;
+		}
+		pthread_mutex_init(&inst->nt_cache.cache->mutex, NULL);
+		talloc_set_destructor(inst->nt_cache.cache, _mschap_nt_cache_free);
+
+		fr_rand_bytes(inst->nt_cache.cache->secret, sizeof(inst->nt_cache.cache->secret));
+	}
+
 	return 0;
 }
 
@@ -679,6 +884,46 @@ static int mod_detach(UNUSED void *instance)
 	return 0;
 }
 
+/** Allocate this thread's ntlm_auth helpers
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_mschap_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_mschap_t const	*inst = instance;
+	rlm_mschap_thread_t	*t = thread;
+
+	t->inst = inst;
+	t->el = el;
+
+	if (inst->method != AUTH_NTLMAUTH_HELPER) return 0;
+
+	t->helpers = mschap_helper_pool_alloc(NULL, inst, el);
+	if (!t->helpers) return -1;
+
+	return 0;
+}
+
+/** Stop this thread's ntlm_auth helpers
+ *
+ * @param[in] thread	specific data.
+ * @return 0.
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_mschap_thread_t	*t = thread;
+
+	TALLOC_FREE(t->helpers);
+
+	return 0;
+}
+
 /*
  *	add_reply() adds either MS-CHAP2-Success or MS-CHAP-Error
  *	attribute to reply packet
@@ -1541,7 +1786,7 @@ static bool CC_HINT(nonnull (1, 2, 4)) find_nt_password(rlm_mschap_t const *inst
 			p = talloc_array(nt_password, uint8_t, NT_DIGEST_LENGTH);
 			fr_pair_value_memsteal(nt_password, p);
 
-			if (mschap_ntpwdhash(p, password->vp_strvalue) < 0) {
+			if (mschap_nt_cache_hash(inst, p, password) < 0) {
 				RERROR("Failed generating NT-Password");
 				return false;
 			}
@@ -1751,6 +1996,171 @@ static rlm_rcode_t CC_HINT(nonnull) process_cpw_request(rlm_mschap_t const *inst
 }
 
 
+/** State needed to finish authentication once the NT-Response has been checked
+ *
+ */
+typedef struct {
+	int			mschap_version;		//!< 1 or 2.
+	VALUE_PAIR		*challenge;		//!< MS-CHAP-Challenge.
+	VALUE_PAIR		*response;		//!< MS-CHAP-Response or MS-CHAP2-Response.
+	VALUE_PAIR		*smb_ctrl;		//!< SMB-Account-Ctrl, may be NULL.
+	VALUE_PAIR		*lm_password;		//!< LM-Password, may be NULL.
+	char const		*username_string;	//!< Used to create the MS-CHAP2-Success.
+	mschap_helper_req_t	*hreq;			//!< Request sent to an ntlm_auth helper.
+} mschap_auth_ctx_t;
+
+/** Add MS-CHAP-Error, or MS-CHAP2-Success and MPPE keys, to the reply
+ *
+ * @param[in] inst		of rlm_mschap.
+ * @param[in] request		The current request.
+ * @param[in] auth_ctx		describing the request.
+ * @param[in] mschap_result	as returned by do_mschap().
+ * @param[in] nthashhash	The hash of the NT hash.
+ * @return Operation status (#rlm_rcode_t).
+ */
+static rlm_rcode_t mschap_finish(rlm_mschap_t const *inst, REQUEST *request, mschap_auth_ctx_t const *auth_ctx,
+				 int mschap_result, uint8_t nthashhash[NT_DIGEST_LENGTH])
+{
+	VALUE_PAIR	*response = auth_ctx->response;
+	char const	*username_string = auth_ctx->username_string;
+	char		msch2resp[42];
+	rlm_rcode_t	rcode;
+
+	/*
+	 *	Check for errors, and add MSCHAP-Error if necessary.
+	 */
+	rcode = mschap_error(inst, request, *response->vp_octets,
+			     mschap_result, auth_ctx->mschap_version, auth_ctx->smb_ctrl);
+	if (rcode != RLM_MODULE_OK) return rcode;
+
+	if (auth_ctx->mschap_version == 2) {
+#ifdef WITH_AUTH_WINBIND
+		VALUE_PAIR *response_name;
+
+		if (inst->wb_retry_with_normalised_username) {
+			if ((response_name = fr_pair_find_by_num(request->packet->vps, FR_MS_CHAP_USER_NAME, 0, TAG_ANY))) {
+				if (strcmp(username_string, response_name->vp_strvalue)) {
+					RDEBUG2("Changing username %s to %s", username_string, response_name->vp_strvalue);
+					username_string = response_name->vp_strvalue;
+				}
+			}
+		}
+#endif
+
+		mschap_auth_response(username_string, 		/* without the domain */
+				     nthashhash, 		/* nt-hash-hash */
+				     response->vp_octets + 26, 	/* peer response */
+				     response->vp_octets + 2, 	/* peer challenge */
+				     auth_ctx->challenge->vp_octets, /* our challenge */
+				     msch2resp);		/* calculated MPPE key */
+		mschap_add_reply(request, *response->vp_octets, "MS-CHAP2-Success", msch2resp, 42);
+	}
+
+	/* now create MPPE attributes */
+	if (inst->use_mppe) {
+		uint8_t mppe_sendkey[34];
+		uint8_t mppe_recvkey[34];
+
+		switch (auth_ctx->mschap_version) {
+		case 1:
+			RDEBUG2("Adding MS-CHAPv1 MPPE keys");
+			memset(mppe_sendkey, 0, 32);
+			if (auth_ctx->lm_password) memcpy(mppe_sendkey, auth_ctx->lm_password->vp_octets, 8);	//-V512
+
+			/*
+			 *	According to RFC 2548 we
+			 *	should send NT hash.  But in
+			 *	practice it doesn't work.
+			 *	Instead, we should send nthashhash
+			 *
+			 *	This is an error in RFC 2548.
+			 */
+			/*
+			 *	do_mschap cares to zero nthashhash if NT hash
+			 *	is not available.
+			 */
+			memcpy(mppe_sendkey + 8, nthashhash, NT_DIGEST_LENGTH);
+			mppe_add_reply(request, "MS-CHAP-MPPE-Keys", mppe_sendkey, 24);	//-V666
+			break;
+
+		case 2:
+			RDEBUG2("Adding MS-CHAPv2 MPPE keys");
+			mppe_chap2_gen_keys128(nthashhash, response->vp_octets + 26, mppe_sendkey, mppe_recvkey);
+
+			mppe_add_reply(request, "MS-MPPE-Recv-Key", mppe_recvkey, 16);
+			mppe_add_reply(request, "MS-MPPE-Send-Key", mppe_sendkey, 16);
+			break;
+
+		default:
+			rad_assert(0);
+			break;
+		}
+
+		pair_make_reply("MS-MPPE-Encryption-Policy",
+			       (inst->require_encryption) ? "0x00000002":"0x00000001", T_OP_EQ);
+		pair_make_reply("MS-MPPE-Encryption-Types",
+			       (inst->require_strong) ? "0x00000004":"0x00000006", T_OP_EQ);
+	} /* else we weren't asked to use MPPE */
+
+	return RLM_MODULE_OK;
+}
+
+/** Finish authentication once an ntlm_auth helper has responded
+ *
+ */
+static rlm_rcode_t mod_authenticate_resume(REQUEST *request, void *instance, UNUSED void *thread, void *rctx)
+{
+	rlm_mschap_t const	*inst = instance;
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(rctx, mschap_auth_ctx_t);
+	uint8_t			nthashhash[NT_DIGEST_LENGTH];
+	int			mschap_result;
+	rlm_rcode_t		rcode;
+
+	memset(nthashhash, 0, sizeof(nthashhash));
+
+	mschap_result = mschap_helper_result(request, auth_ctx->hreq, nthashhash);
+	auth_ctx->hreq = NULL;
+
+	rcode = mschap_finish(inst, request, auth_ctx, mschap_result, nthashhash);
+	talloc_free(auth_ctx);
+
+	return rcode;
+}
+
+/** Request was cancelled, stop waiting for the ntlm_auth helper
+ *
+ */
+static void mod_authenticate_signal(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+				    void *rctx, fr_state_action_t action)
+{
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(rctx, mschap_auth_ctx_t);
+
+	if (action != FR_ACTION_DONE) return;
+
+	if (auth_ctx->hreq) mschap_helper_cancel(auth_ctx->hreq);
+	talloc_free(auth_ctx);
+}
+
+/** Send the NT-Response to an ntlm_auth helper, and yield until it responds
+ *
+ */
+static rlm_rcode_t mod_authenticate_yield(rlm_mschap_thread_t *t, REQUEST *request, mschap_auth_ctx_t const *auth_ctx,
+				       uint8_t const *challenge, uint8_t const *response)
+{
+	mschap_auth_ctx_t	*ctx;
+
+	MEM(ctx = talloc_memdup(request, auth_ctx, sizeof(*ctx)));
+	talloc_set_type(ctx, mschap_auth_ctx_t);
+
+	ctx->hreq = mschap_helper_auth(t->helpers, request, challenge, response);
+	if (!ctx->hreq) {
+		talloc_free(ctx);
+		return RLM_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, mod_authenticate_resume, mod_authenticate_signal, ctx);
+}
+
 /*
  *	mod_authenticate() - authenticate user based on given
  *	attributes and configuration.
@@ -1768,7 +2178,7 @@ static rlm_rcode_t CC_HINT(nonnull) process_cpw_request(rlm_mschap_t const *inst
  *	If MS-CHAP2 succeeds we MUST return
  *	FR_MSCHAP2_SUCCESS
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, void *thread, REQUEST *request)
 {
 	rlm_mschap_t const *inst = instance;
 	VALUE_PAIR *challenge = NULL;
@@ -1778,11 +2188,11 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 	VALUE_PAIR *lm_password, *nt_password, *smb_ctrl;
 	VALUE_PAIR *username;
 	uint8_t nthashhash[NT_DIGEST_LENGTH];
-	char msch2resp[42];
 	char const *username_string;
 	int mschap_version = 0;
 	int mschap_result;
 	MSCHAP_AUTH_METHOD auth_method;
+	mschap_auth_ctx_t auth_ctx;
 
 	/*
 	 *	If we have ntlm_auth configured, use it unless told
@@ -1907,7 +2317,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 	 */
 	if (response) {
 		int		offset;
-		rlm_rcode_t	rcode;
 		mschap_version = 1;
 
 		/*
@@ -1940,22 +2349,28 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 			offset = 2;
 		}
 
+		auth_ctx = (mschap_auth_ctx_t) {
+			.mschap_version = mschap_version,
+			.challenge = challenge,
+			.response = response,
+			.smb_ctrl = smb_ctrl,
+			.lm_password = lm_password
+		};
+
+		if (auth_method == AUTH_NTLMAUTH_HELPER) {
+			return mod_authenticate_yield(thread, request, &auth_ctx,
+						      challenge->vp_octets, response->vp_octets + offset);
+		}
+
 		/*
 		 *	Do the MS-CHAP authentication.
 		 */
 		mschap_result = do_mschap(inst, request, password, challenge->vp_octets,
 					  response->vp_octets + offset, nthashhash, auth_method);
-		/*
-		 *	Check for errors, and add MSCHAP-Error if necessary.
-		 */
-		rcode = mschap_error(inst, request, *response->vp_octets,
-				     mschap_result, mschap_version, smb_ctrl);
-		if (rcode != RLM_MODULE_OK) return rcode;
 	} else if ((response = fr_pair_find_by_num(request->packet->vps, VENDORPEC_MICROSOFT, FR_MSCHAP2_RESPONSE,
 						   TAG_ANY)) != NULL) {
 		uint8_t		mschapv1_challenge[16];
 		VALUE_PAIR	*name_attr, *response_name;
-		rlm_rcode_t	rcode;
 
 		mschap_version = 2;
 
@@ -2047,88 +2462,29 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 				      mschapv1_challenge);	/* resulting challenge */
 
 		RDEBUG2("Client is using MS-CHAPv2");
-		mschap_result = do_mschap(inst, request, nt_password, mschapv1_challenge,
-					  response->vp_octets + 26, nthashhash, auth_method);
 
-		/*
-		 *	Check for errors, and add MSCHAP-Error if necessary.
-		 */
-		rcode = mschap_error(inst, request, *response->vp_octets,
-				     mschap_result, mschap_version, smb_ctrl);
-		if (rcode != RLM_MODULE_OK) return rcode;
+		auth_ctx = (mschap_auth_ctx_t) {
+			.mschap_version = mschap_version,
+			.challenge = challenge,
+			.response = response,
+			.smb_ctrl = smb_ctrl,
+			.lm_password = lm_password,
+			.username_string = username_string
+		};
 
-#ifdef WITH_AUTH_WINBIND
-		if (inst->wb_retry_with_normalised_username) {
-			if ((response_name = fr_pair_find_by_num(request->packet->vps, FR_MS_CHAP_USER_NAME, 0, TAG_ANY))) {
-				if (strcmp(username_string, response_name->vp_strvalue)) {
-					RDEBUG2("Changing username %s to %s", username_string, response_name->vp_strvalue);
-					username_string = response_name->vp_strvalue;
-				}
-			}
+		if (auth_method == AUTH_NTLMAUTH_HELPER) {
+			return mod_authenticate_yield(thread, request, &auth_ctx,
+						      mschapv1_challenge, response->vp_octets + 26);
 		}
-#endif
-
-		mschap_auth_response(username_string, 		/* without the domain */
-				     nthashhash, 		/* nt-hash-hash */
-				     response->vp_octets + 26, 	/* peer response */
-				     response->vp_octets + 2, 	/* peer challenge */
-				     challenge->vp_octets, 	/* our challenge */
-				     msch2resp);		/* calculated MPPE key */
-		mschap_add_reply(request, *response->vp_octets, "MS-CHAP2-Success", msch2resp, 42);
-
 
+		mschap_result = do_mschap(inst, request, nt_password, mschapv1_challenge,
+					  response->vp_octets + 26, nthashhash, auth_method);
 	} else {		/* Neither CHAPv1 or CHAPv2 response: die */
 		REDEBUG("You set 'Auth-Type = MS-CHAP' for a request that does not contain any MS-CHAP attributes!");
 		return RLM_MODULE_INVALID;
 	}
 
-	/* now create MPPE attributes */
-	if (inst->use_mppe) {
-		uint8_t mppe_sendkey[34];
-		uint8_t mppe_recvkey[34];
-
-		switch (mschap_version) {
-		case 1:
-			RDEBUG2("Adding MS-CHAPv1 MPPE keys");
-			memset(mppe_sendkey, 0, 32);
-			if (lm_password) memcpy(mppe_sendkey, lm_password->vp_octets, 8);	//-V512
-
-			/*
-			 *	According to RFC 2548 we
-			 *	should send NT hash.  But in
-			 *	practice it doesn't work.
-			 *	Instead, we should send nthashhash
-			 *
-			 *	This is an error in RFC 2548.
-			 */
-			/*
-			 *	do_mschap cares to zero nthashhash if NT hash
-			 *	is not available.
-			 */
-			memcpy(mppe_sendkey + 8, nthashhash, NT_DIGEST_LENGTH);
-			mppe_add_reply(request, "MS-CHAP-MPPE-Keys", mppe_sendkey, 24);	//-V666
-			break;
-
-		case 2:
-			RDEBUG2("Adding MS-CHAPv2 MPPE keys");
-			mppe_chap2_gen_keys128(nthashhash, response->vp_octets + 26, mppe_sendkey, mppe_recvkey);
-
-			mppe_add_reply(request, "MS-MPPE-Recv-Key", mppe_recvkey, 16);
-			mppe_add_reply(request, "MS-MPPE-Send-Key", mppe_sendkey, 16);
-			break;
-
-		default:
-			rad_assert(0);
-			break;
-		}
-
-		pair_make_reply("MS-MPPE-Encryption-Policy",
-			       (inst->require_encryption) ? "0x00000002":"0x00000001", T_OP_EQ);
-		pair_make_reply("MS-MPPE-Encryption-Types",
-			       (inst->require_strong) ? "0x00000004":"0x00000006", T_OP_EQ);
-	} /* else we weren't asked to use MPPE */
-
-	return RLM_MODULE_OK;
+	return mschap_finish(inst, request, &auth_ctx, mschap_result, nthashhash);
 #undef inst
 }
 
@@ -2142,6 +2498,9 @@ rad_module_t rlm_mschap = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_mschap_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
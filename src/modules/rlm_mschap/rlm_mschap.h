@@ -20,8 +20,13 @@ typedef enum {
 #ifdef WITH_AUTH_WINBIND
 	,AUTH_WBCLIENT       	= 2
 #endif
+	,AUTH_NTLMAUTH_HELPER	= 3
 } MSCHAP_AUTH_METHOD;
 
+typedef struct mschap_helper_pool mschap_helper_pool_t;
+typedef struct mschap_helper_limits mschap_helper_limits_t;
+typedef struct mschap_nt_cache mschap_nt_cache_t;
+
 typedef struct rlm_mschap_t {
 	bool			use_mppe;
 	bool			require_encryption;
@@ -47,7 +52,27 @@ typedef struct rlm_mschap_t {
 #ifdef __APPLE__
 	bool			open_directory;
 #endif
+
+	struct {
+		char const		*program;		//!< ntlm_auth in ntlm-server-1 helper mode.
+		uint32_t		num;			//!< Helpers to run per worker thread.
+		uint32_t		max_requests;		//!< Restart a helper after this many requests.
+		uint32_t		max_outstanding;	//!< Maximum requests in flight per domain.
+		mschap_helper_limits_t	*limits;		//!< Requests in flight per domain.
+	} helper;
+
+	struct {
+		uint32_t		max_entries;		//!< Maximum number of NT hashes to remember.
+		uint32_t		lifetime;		//!< How long to remember them for.
+		mschap_nt_cache_t	*cache;			//!< NT hashes of Cleartext-Passwords.
+	} nt_cache;
 } rlm_mschap_t;
 
+typedef struct {
+	rlm_mschap_t const	*inst;			//!< Instance of rlm_mschap.
+	fr_event_list_t		*el;			//!< This thread's event list.
+	mschap_helper_pool_t	*helpers;		//!< ntlm_auth helpers owned by this thread.
+} rlm_mschap_thread_t;
+
 #endif
 
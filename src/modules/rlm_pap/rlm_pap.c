@@ -32,6 +32,7 @@ USES_APPLE_DEPRECATED_API
 #include <freeradius-devel/rad_assert.h>
 
 #include <ctype.h>
+#include <pthread.h>
 
 #include "../../include/md5.h"
 #include "../../include/sha1.h"
@@ -47,17 +48,58 @@ USES_APPLE_DEPRECATED_API
  *      a lot cleaner to do so, and a pointer to the structure can
  *      be used as the instance handle.
  */
+typedef struct pap_cache pap_cache_t;
+
 typedef struct rlm_pap_t {
 	char const	*name;
 	int		auth_type;
 	bool		normify;
+
+	struct {
+		uint32_t	max_entries;		//!< Maximum number of verifications to remember.
+		uint32_t	lifetime;		//!< How long to remember them for.
+	} cache_conf;
+
+	pap_cache_t	*cache;				//!< Successful verifications of expensive hashes.
 } rlm_pap_t;
 
+static const CONF_PARSER cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_pap_t, cache_conf.max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("lifetime", FR_TYPE_UINT32, rlm_pap_t, cache_conf.lifetime), .dflt = "30" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("normalise", FR_TYPE_BOOL, rlm_pap_t, normify), .dflt = "yes" },
+	{ FR_CONF_POINTER("cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
+/** A successful verification
+ *
+ * Only the HMAC of the user name, password and "known good" hash is stored,
+ * so the cache can't be used to recover passwords.
+ */
+typedef struct pap_cache_entry pap_cache_entry_t;
+struct pap_cache_entry {
+	uint8_t			key[SHA1_DIGEST_LENGTH];	//!< HMAC of the credentials.
+	time_t			expires;			//!< When the entry should be removed.
+
+	pap_cache_entry_t	*prev;				//!< Previous (older) entry.
+	pap_cache_entry_t	*next;				//!< Next (newer) entry.
+};
+
+struct pap_cache {
+	pthread_mutex_t		mutex;				//!< Protects the tree and list.
+	rbtree_t		*tree;				//!< Entries indexed by key.
+
+	pap_cache_entry_t	*head;				//!< Oldest entry.
+	pap_cache_entry_t	*tail;				//!< Newest entry.
+
+	uint8_t			secret[32];			//!< HMAC key.  Generated at startup,
+								//!< and never leaves the process.
+};
+
 /*
  *	For auto-header discovery.
  *
@@ -98,6 +140,172 @@ static const FR_NAME_NUMBER header_names[] = {
 	{ NULL, 0 }
 };
 
+static int pap_cache_entry_cmp(void const *one, void const *two)
+{
+	pap_cache_entry_t const *a = one, *b = two;
+
+	return memcmp(a->key, b->key, sizeof(a->key));
+}
+
+static int _pap_cache_free(pap_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+	memset(cache->secret, 0, sizeof(cache->secret));
+
+	return 0;
+}
+
+/** Unlink and free an entry
+ *
+ * Must be called with the mutex held.
+ */
+static void pap_cache_entry_free(pap_cache_t *cache, pap_cache_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+
+	rbtree_deletebydata(cache->tree, entry);
+	talloc_free(entry);
+}
+
+/** Remove expired entries
+ *
+ * Entries all have the same lifetime, so the list is in expiry order.
+ * Must be called with the mutex held.
+ */
+static void pap_cache_expire(pap_cache_t *cache, time_t now)
+{
+	while (cache->head && (cache->head->expires <= now)) pap_cache_entry_free(cache, cache->head);
+}
+
+/** Calculate the cache key for the current request
+ *
+ * The key covers the user name, the password the user supplied, and the
+ * "known good" hash, so changing the stored hash invalidates the entry.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the credentials are too long to cache.
+ */
+static int pap_cache_key(uint8_t key[SHA1_DIGEST_LENGTH], pap_cache_t const *cache,
+			 REQUEST *request, VALUE_PAIR const *known_good)
+{
+	uint8_t		buff[2048], *p = buff;
+	VALUE_PAIR	*username;
+	size_t		user_len;
+
+	username = fr_pair_find_by_num(request->packet->vps, 0, FR_USER_NAME, TAG_ANY);
+	user_len = username ? username->vp_length : 0;
+
+	if ((2 + user_len + 2 + request->password->vp_length + 4 + known_good->vp_length) > sizeof(buff)) return -1;
+
+	/*
+	 *	Length prefix the variable length fields,
+	 *	so they can't be shuffled to produce the
+	 *	same input.
+	 */
+	*p++ = (user_len >> 8) & 0xff;
+	*p++ = user_len & 0xff;
+	if (user_len) {
+		memcpy(p, username->vp_strvalue, user_len);
+		p += user_len;
+	}
+
+	*p++ = (request->password->vp_length >> 8) & 0xff;
+	*p++ = request->password->vp_length & 0xff;
+	memcpy(p, request->password->vp_octets, request->password->vp_length);
+	p += request->password->vp_length;
+
+	*p++ = (known_good->da->attr >> 24) & 0xff;
+	*p++ = (known_good->da->attr >> 16) & 0xff;
+	*p++ = (known_good->da->attr >> 8) & 0xff;
+	*p++ = known_good->da->attr & 0xff;
+	memcpy(p, known_good->vp_octets, known_good->vp_length);
+	p += known_good->vp_length;
+
+	fr_hmac_sha1(key, buff, p - buff, cache->secret, sizeof(cache->secret));
+	memset(buff, 0, sizeof(buff));
+
+	return 0;
+}
+
+/** Check whether these credentials were verified recently
+ *
+ * @return
+ *	- true if the credentials were verified, and the entry hasn't expired.
+ *	- false otherwise.
+ */
+static bool pap_cache_find(rlm_pap_t const *inst, uint8_t const key[SHA1_DIGEST_LENGTH])
+{
+	pap_cache_t		*cache = inst->cache;
+	pap_cache_entry_t	find, *entry;
+	bool			found;
+
+	memcpy(find.key, key, sizeof(find.key));
+
+	pthread_mutex_lock(&cache->mutex);
+	pap_cache_expire(cache, time(NULL));
+	entry = rbtree_finddata(cache->tree, &find);
+	found = (entry != NULL);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return found;
+}
+
+/** Remember that these credentials were verified
+ *
+ * If the cache is full, the oldest entry is evicted.
+ */
+static void pap_cache_add(rlm_pap_t const *inst, uint8_t const key[SHA1_DIGEST_LENGTH])
+{
+	pap_cache_t		*cache = inst->cache;
+	pap_cache_entry_t	*entry;
+	time_t			now = time(NULL);
+
+	pthread_mutex_lock(&cache->mutex);
+	pap_cache_expire(cache, now);
+
+	while (cache->head && (rbtree_num_elements(cache->tree) >= inst->cache_conf.max_entries)) {
+		pap_cache_entry_free(cache, cache->head);
+	}
+
+	entry = talloc_zero(cache, pap_cache_entry_t);
+	if (!entry) {
+		pthread_mutex_unlock(&cache->mutex);
+		return;
+	}
+	memcpy(entry->key, key, sizeof(entry->key));
+	entry->expires = now + inst->cache_conf.lifetime;
+
+	/*
+	 *	Another thread verified the same
+	 *	credentials at the same time.
+	 */
+	if (!rbtree_insert(cache->tree, entry)) {
+		pthread_mutex_unlock(&cache->mutex);
+		talloc_free(entry);
+		return;
+	}
+
+	entry->prev = cache->tail;
+	if (cache->tail) {
+		cache->tail->next = entry;
+	} else {
+		cache->head = entry;
+	}
+	cache->tail = entry;
+	pthread_mutex_unlock(&cache->mutex);
+}
+
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	rlm_pap_t		*inst = instance;
@@ -115,6 +323,22 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		inst->auth_type = 0;
 	}
 
+	if (inst->cache_conf.max_entries) {
+		FR_INTEGER_BOUND_CHECK("cache.lifetime", inst->cache_conf.lifetime, >=, 1);
+		FR_INTEGER_BOUND_CHECK("cache.lifetime", inst->cache_conf.lifetime, <=, 3600);
+
+		MEM(inst->cache = talloc_zero(inst, pap_cache_t));
+		inst->cache->tree = rbtree_create(inst->cache, pap_cache_entry_cmp, NULL, 0);
+		if (!inst->cache->tree) {
+			cf_log_err(conf, "Failed creating cache");
+			return -1;
+		}
+		pthread_mutex_init(&inst->cache->mutex, NULL);
+		talloc_set_destructor(inst->cache, _pap_cache_free);
+
+		fr_rand_bytes(inst->cache->secret, sizeof(inst->cache->secret));
+	}
+
 	return 0;
 }
 
@@ -1029,11 +1253,34 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 		return RLM_MODULE_FAIL;
 	}
 
+	/*
+	 *	Crypt hashes (sha512-crypt, bcrypt etc.) are
+	 *	deliberately expensive to calculate.  If we
+	 *	verified the same credentials recently, don't
+	 *	calculate the hash again.
+	 */
+	if (inst->cache && (auth_func == &pap_auth_crypt)) {
+		uint8_t key[SHA1_DIGEST_LENGTH];
+
+		if (pap_cache_key(key, inst->cache, request, vp) == 0) {
+			if (pap_cache_find(inst, key)) {
+				RDEBUG("Credentials were verified recently, skipping hash calculation");
+				RDEBUG("User authenticated successfully");
+				return RLM_MODULE_OK;
+			}
+
+			rc = auth_func(inst, request, vp);
+			if (rc == RLM_MODULE_OK) pap_cache_add(inst, key);
+			goto done;
+		}
+	}
+
 	/*
 	 *	Authenticate, and return.
 	 */
 	rc = auth_func(inst, request, vp);
 
+done:
 	if (rc == RLM_MODULE_REJECT) {
 		RDEBUG("Passwords don't match");
 	}
@@ -1059,6 +1306,7 @@ extern rad_module_t rlm_pap;
 rad_module_t rlm_pap = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "pap",
+	.type		= RLM_TYPE_SHADOW_SAFE,
 	.inst_size	= sizeof(rlm_pap_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
@@ -28,6 +28,8 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/reload.h>
+#include <freeradius-devel/mapfile.h>
 
 struct mypasswd {
 	struct mypasswd *next;
@@ -41,6 +43,7 @@ struct hashtable {
 	int nfields;
 	int islist;
 	int ignorenis;
+	uint64_t entries;
 	char * filename;
 	struct mypasswd **table;
 	char buffer[1024];
@@ -63,14 +66,14 @@ void printpw(struct mypasswd *pw, int nfields){
 #endif
 
 
-static struct mypasswd *mypasswd_alloc(char const* buffer, int nfields, size_t* len)
+static struct mypasswd *mypasswd_alloc(TALLOC_CTX *ctx, char const* buffer, int nfields, size_t* len)
 {
 	struct mypasswd *t;
 	/* reserve memory for (struct mypasswd) + listflag (nfields * sizeof (char*)) +
 	** fields (nfields * sizeof (char)) + strlen (inst->format) + 1 */
 
 	*len = sizeof(struct mypasswd) + nfields * sizeof (char*) + nfields * sizeof (char ) + strlen(buffer) + 1;
-	MEM(t = (struct mypasswd *)talloc_zero_array(NULL, uint8_t, *len));
+	MEM(t = (struct mypasswd *)talloc_zero_array(ctx, uint8_t, *len));
 
 	return t;
 }
@@ -145,13 +148,15 @@ static void release_hash_table(struct hashtable * ht){
 	ht->tablesize = 0;
 }
 
+#ifdef TEST
 static void release_ht(struct hashtable * ht){
 	if (!ht) return;
 	release_hash_table(ht);
 	talloc_free(ht);
 }
+#endif
 
-static struct hashtable * build_hash_table (char const * file, int nfields,
+static struct hashtable * build_hash_table (TALLOC_CTX *ctx, char const * file, int nfields,
 					    int keyfield, int islist, int tablesize, int ignorenis, char delimiter)
 {
 	struct hashtable* ht;
@@ -163,7 +168,7 @@ static struct hashtable * build_hash_table (char const * file, int nfields,
 	int i;
 	char buffer[1024];
 
-	MEM(ht = talloc_zero(NULL, struct hashtable));
+	MEM(ht = talloc_zero(ctx, struct hashtable));
 	MEM(ht->filename = talloc_typed_strdup(ht, file));
 
 	ht->tablesize = tablesize;
@@ -189,7 +194,7 @@ static struct hashtable * build_hash_table (char const * file, int nfields,
 	MEM(ht->table = talloc_zero_array(ht, struct mypasswd *, tablesize));
 	while (fgets(buffer, 1024, ht->fp)) {
 		if(*buffer && *buffer!='\n' && (!ignorenis || (*buffer != '+' && *buffer != '-')) ){
-			hashentry = mypasswd_alloc(buffer, nfields, &len);
+			hashentry = mypasswd_alloc(ht, buffer, nfields, &len);
 			if (!hashentry){
 				release_hash_table(ht);
 				return ht;
@@ -210,12 +215,13 @@ static struct hashtable * build_hash_table (char const * file, int nfields,
 			h = hash(hashentry->field[keyfield], tablesize);
 			hashentry->next = ht->table[h];
 			ht->table[h] = hashentry;
+			ht->entries++;
 			if (islist) {
 				for (list=nextlist; nextlist; list = nextlist){
 					for (nextlist = list; *nextlist && *nextlist!=','; nextlist++);
 					if (*nextlist) *nextlist++ = 0;
 					else nextlist = 0;
-					if(!(hashentry1 = mypasswd_alloc("", nfields, &len))){
+					if(!(hashentry1 = mypasswd_alloc(ht, "", nfields, &len))){
 						release_hash_table(ht);
 						return ht;
 					}
@@ -325,7 +331,7 @@ int main(void){
 	struct mypasswd* pw, *last_found;
 	int i;
 
-	ht = build_hash_table("/etc/group", 4, 3, 1, 100, 0, ":");
+	ht = build_hash_table(NULL, "/etc/group", 4, 3, 1, 100, 0, ":");
 	if(!ht) {
 		printf("Hash table not built\n");
 		return -1;
@@ -350,13 +356,16 @@ int main(void){
 
 #else  /* TEST */
 typedef struct rlm_passwd_t {
-	struct hashtable	*ht;
+	char const		*name;
+	fr_reload_t		*reload;	//!< Gives us the current hashtable.
+	struct timeval		reload_interval;
 	struct mypasswd		*pwdfmt;
 	char const		*filename;
 	char const		*format;
 	char const		*delimiter;
 	bool			allow_multiple;
 	bool			ignore_nislike;
+	bool			mmap;		//!< Look records up in the mapped file, instead of a hash table.
 	uint32_t		hash_size;
 	uint32_t		nfields;
 	uint32_t		keyfield;
@@ -377,9 +386,104 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("allow_multiple_keys", FR_TYPE_BOOL, rlm_passwd_t, allow_multiple), .dflt = "no" },
 
 	{ FR_CONF_OFFSET("hash_size", FR_TYPE_UINT32, rlm_passwd_t, hash_size), .dflt = "100" },
+
+	{ FR_CONF_OFFSET("mmap", FR_TYPE_BOOL, rlm_passwd_t, mmap), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("reload_interval", FR_TYPE_TIMEVAL, rlm_passwd_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
+static char passwd_delimiter(rlm_passwd_t const *inst)
+{
+	return *inst->delimiter ? *inst->delimiter : ':';
+}
+
+/** Find the key (or keys) of one line of the mapped file
+ *
+ * The same records are indexed as by build_hash_table().
+ */
+static int passwd_mapfile_key(fr_mapfile_t *mf, char const *line, size_t len, UNUSED uint64_t lineno, void *uctx)
+{
+	rlm_passwd_t const	*inst = uctx;
+	char			delimiter = passwd_delimiter(inst);
+	char const		*p, *key, *end = line + len;
+	uint32_t		i;
+
+	if (!len) return 0;
+	if (inst->ignore_nislike && ((*line == '+') || (*line == '-'))) return 0;
+
+	p = line;
+	for (i = 0; i < inst->keyfield; i++) {
+		p = memchr(p, delimiter, end - p);
+		if (!p) return 0;
+		p++;
+	}
+	key = p;
+
+	/*
+	 *	The last field is the rest of the line.
+	 */
+	if (inst->keyfield == (inst->nfields - 1)) {
+		p = end;
+	} else {
+		p = memchr(key, delimiter, end - key);
+		if (!p) p = end;
+	}
+	if (p == key) return 0;
+
+	if (!inst->listable) {
+		fr_mapfile_add(mf, key, p - key);
+		return 0;
+	}
+
+	while (key < p) {
+		char const *comma;
+
+		comma = memchr(key, ',', p - key);
+		if (!comma) comma = p;
+
+		if (comma > key) fr_mapfile_add(mf, key, comma - key);
+		key = comma + 1;
+	}
+
+	return 0;
+}
+
+/** Read the passwd file
+ *
+ * Called when the module is instantiated, and from the reload thread.
+ */
+static void *passwd_load(TALLOC_CTX *ctx, char const *filename, void *uctx, uint64_t *entries)
+{
+	rlm_passwd_t const	*inst = uctx;
+	struct hashtable	*ht;
+
+	if (inst->mmap) {
+		fr_mapfile_t *mf;
+
+		mf = fr_mapfile_alloc(ctx, filename, passwd_mapfile_key, uctx);
+		if (!mf) {
+			PERROR("Can't index passwd file");
+			return NULL;
+		}
+
+		*entries = fr_mapfile_num_keys(mf);
+
+		return mf;
+	}
+
+	ht = build_hash_table(ctx, filename, inst->nfields, inst->keyfield, inst->listable,
+			      inst->hash_size, inst->ignore_nislike, passwd_delimiter(inst));
+	if (!ht) {
+		ERROR("Can't build hashtable from passwd file %s: %s", filename, fr_syserror(errno));
+		return NULL;
+	}
+
+	*entries = ht->entries;
+
+	return ht;
+}
+
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	int			nfields = 0, keyfield = -1, listable = 0;
@@ -393,11 +497,19 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	rad_assert(inst->filename && *inst->filename);
 	rad_assert(inst->format && *inst->format);
 
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
 	if (inst->hash_size == 0) {
 		cf_log_err(conf, "Invalid value '0' for hash_size");
 		return -1;
 	}
 
+	if (timerisset(&inst->reload_interval)) {
+		FR_TIMEVAL_BOUND_CHECK("reload_interval", &inst->reload_interval, >=, 1, 0);
+		FR_TIMEVAL_BOUND_CHECK("reload_interval", &inst->reload_interval, <=, 86400, 0);
+	}
+
 	lf = talloc_typed_strdup(inst, inst->format);
 	if (!lf) {
 		ERROR("Memory allocation failed for lf");
@@ -434,24 +546,13 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
-	inst->ht = build_hash_table(inst->filename, nfields, keyfield, listable,
-				    inst->hash_size, inst->ignore_nislike, *inst->delimiter);
-	if (!inst->ht){
-		ERROR("Can't build hashtable from passwd file");
-		return -1;
-	}
-
-	inst->pwdfmt = mypasswd_alloc(inst->format, nfields, &len);
+	inst->pwdfmt = mypasswd_alloc(NULL, inst->format, nfields, &len);
 	if (!inst->pwdfmt){
 		ERROR("Memory allocation failed");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 	if (!string_to_entry(inst->format, nfields, ':', inst->pwdfmt , len)) {
 		ERROR("Unable to convert format entry");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -466,14 +567,10 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	}
 	if (!*inst->pwdfmt->field[keyfield]) {
 		cf_log_err(conf, "key field is empty");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 	if (!(da = fr_dict_attr_by_name(NULL, inst->pwdfmt->field[keyfield]))) {
 		ERROR("Unable to resolve attribute: %s", inst->pwdfmt->field[keyfield]);
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -485,6 +582,9 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	DEBUG3("nfields: %d keyfield %d(%s) listable: %s", nfields, keyfield,
 	       inst->pwdfmt->field[keyfield], listable ? "yes" : "no");
 
+	inst->reload = fr_reload_alloc(inst, inst->name, inst->filename, &inst->reload_interval, passwd_load, inst);
+	if (!inst->reload) return -1;
+
 	return 0;
 
 #undef inst
@@ -492,10 +592,10 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 static int mod_detach (void *instance) {
 #define inst ((rlm_passwd_t *)instance)
-	if(inst->ht) {
-		release_ht(inst->ht);
-		inst->ht = NULL;
-	}
+	/*
+	 *	Stop the reload thread before we free the format.
+	 */
+	TALLOC_FREE(inst->reload);
 	talloc_free(inst->pwdfmt);
 	return 0;
 #undef inst
@@ -520,12 +620,83 @@ static void result_add(TALLOC_CTX *ctx, rlm_passwd_t const *inst, REQUEST *reque
 	}
 }
 
+/** See whether a record has the key
+ *
+ */
+static bool passwd_key_match(rlm_passwd_t const *inst, struct mypasswd const *pw, char const *name)
+{
+	char const	*key = pw->field[inst->keyfield];
+	size_t		len = strlen(name);
+
+	if (!key) return false;
+
+	if (!inst->listable) return (strcmp(key, name) == 0);
+
+	while (*key) {
+		char const *comma;
+
+		comma = strchr(key, ',');
+		if (!comma) comma = key + strlen(key);
+
+		if (((size_t) (comma - key) == len) && (memcmp(key, name, len) == 0)) return true;
+
+		if (!*comma) break;
+		key = comma + 1;
+	}
+
+	return false;
+}
+
+/** Add the attributes from every record in the mapped file which has the key
+ *
+ * @return the number of records which were found.
+ */
+static int passwd_map_mmap(rlm_passwd_t const *inst, REQUEST *request, fr_mapfile_t const *mf, char const *name)
+{
+	fr_mapfile_cursor_t	cursor;
+	char const		*line;
+	size_t			len;
+	int			found = 0;
+
+	for (line = fr_mapfile_find(mf, &cursor, name, strlen(name), &len);
+	     line;
+	     line = fr_mapfile_next(mf, &cursor, &len)) {
+		struct mypasswd	*pw;
+		char		*str;
+		size_t		pw_len;
+
+		/*
+		 *	Fields are only split out of the lines we
+		 *	find.  Different keys can have the same hash,
+		 *	so check the key, too.
+		 */
+		MEM(str = talloc_bstrndup(request, line, len));
+		pw = mypasswd_alloc(str, str, inst->nfields, &pw_len);
+		if (!string_to_entry(str, inst->nfields, passwd_delimiter(inst), pw, pw_len) ||
+		    !passwd_key_match(inst, pw, name)) {
+			talloc_free(str);
+			continue;
+		}
+
+		result_add(request, inst, request, &request->control, pw, 0, "config");
+		result_add(request->reply, inst, request, &request->reply->vps, pw, 1, "reply_items");
+		result_add(request->packet, inst, request, &request->packet->vps, pw, 2, "request_items");
+
+		talloc_free(str);
+		found++;
+	}
+
+	return found;
+}
+
 static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_passwd_t const	*inst = instance;
 
 	char			buffer[1024];
 	VALUE_PAIR		*key, *i;
+	void const		*data;
+	struct hashtable	*ht;
 	struct mypasswd		*pw, *last_found;
 	vp_cursor_t		cursor;
 	int			found = 0;
@@ -535,6 +706,14 @@ static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, UNUSED void *
 		return RLM_MODULE_NOTFOUND;
 	}
 
+	/*
+	 *	The hash table (or index) is never changed once it's
+	 *	built, so looking things up in it is safe from any
+	 *	thread.
+	 */
+	data = fr_reload_enter(inst->reload, NULL);
+	memcpy(&ht, &data, sizeof(ht));	/* const */
+
 	for (i = fr_pair_cursor_init(&cursor, &key);
 	     i;
 	     i = fr_pair_cursor_next_by_num(&cursor, inst->keyattr->vendor, inst->keyattr->attr, TAG_ANY)) {
@@ -542,14 +721,18 @@ static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, UNUSED void *
 		 *	Ensure we have the string form of the attribute
 		 */
 		fr_pair_value_snprint(buffer, sizeof(buffer), i, 0);
-		if (!(pw = get_pw_nam(buffer, inst->ht, &last_found)) ) {
-			continue;
+		if (inst->mmap) {
+			if (!*buffer || !passwd_map_mmap(inst, request, data, buffer)) continue;
+		} else {
+			if (!(pw = get_pw_nam(buffer, ht, &last_found)) ) {
+				continue;
+			}
+			do {
+				result_add(request, inst, request, &request->control, pw, 0, "config");
+				result_add(request->reply, inst, request, &request->reply->vps, pw, 1, "reply_items");
+				result_add(request->packet, inst, request, &request->packet->vps, pw, 2, "request_items");
+			} while ((pw = get_next(buffer, ht, &last_found)));
 		}
-		do {
-			result_add(request, inst, request, &request->control, pw, 0, "config");
-			result_add(request->reply, inst, request, &request->reply->vps, pw, 1, "reply_items");
-			result_add(request->packet, inst, request, &request->packet->vps, pw, 2, "request_items");
-		} while ((pw = get_next(buffer, inst->ht, &last_found)));
 
 		found++;
 
@@ -558,6 +741,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, UNUSED void *
 		}
 	}
 
+	fr_reload_leave(inst->reload);
+
 	if (!found) return RLM_MODULE_NOTFOUND;
 
 	return RLM_MODULE_OK;
@@ -569,6 +754,7 @@ extern rad_module_t rlm_passwd;
 rad_module_t rlm_passwd = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "passwd",
+	.type		= RLM_TYPE_HUP_SAFE,
 	.inst_size	= sizeof(rlm_passwd_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
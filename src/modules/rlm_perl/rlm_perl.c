@@ -85,6 +85,11 @@ typedef struct rlm_perl_t {
 	HV		*rad_perlconf_hv;	//!< holds "config" items (perl %RAD_PERLCONF hash).
 
 } rlm_perl_t;
+
+typedef struct rlm_perl_thread_t {
+	rlm_perl_t const	*inst;		//!< Instance of rlm_perl.
+	PerlInterpreter		*perl;		//!< Thread specific perl interpreter.
+} rlm_perl_thread_t;
 /*
  *	A mapping of configuration file names to internal variables.
  */
@@ -227,12 +232,11 @@ static void rlm_destroy_perl(PerlInterpreter *perl)
 	rlm_perl_destruct(perl);
 }
 
-/* Create Key */
-static void rlm_perl_make_key(pthread_key_t *key)
-{
-	pthread_key_create(key, (void (*)(void *))rlm_destroy_perl);
-}
-
+/** Clone the parent interpreter for a worker thread
+ *
+ * Modules loaded by the parent are already loaded in the clone, so the
+ * clone is ready to use immediately.  Must be called with clone_mutex held.
+ */
 static PerlInterpreter *rlm_perl_clone(PerlInterpreter *perl, pthread_key_t *key)
 {
 	int ret;
@@ -242,9 +246,6 @@ static PerlInterpreter *rlm_perl_clone(PerlInterpreter *perl, pthread_key_t *key
 
 	PERL_SET_CONTEXT(perl);
 
-	interp = pthread_getspecific(*key);
-	if (interp) return interp;
-
 	interp = perl_clone(perl, clone_flags);
 	{
 		dTHXa(interp);
@@ -359,13 +360,21 @@ static ssize_t perl_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
 #ifdef USE_ITHREADS
 	PerlInterpreter *interp;
 
-	pthread_mutex_lock(&inst->clone_mutex);
-	interp = rlm_perl_clone(inst->perl, inst->thread_key);
+	/*
+	 *	xlats don't get the thread instance, so workers
+	 *	register their interpreter against the thread key.
+	 *	Outside of the workers, use the parent interpreter,
+	 *	one thread at a time.
+	 */
+	interp = pthread_getspecific(*inst->thread_key);
+	if (!interp) {
+		pthread_mutex_lock(&inst->clone_mutex);
+		interp = inst->perl;
+	}
 	{
 		dTHXa(interp);
 		PERL_SET_CONTEXT(interp);
 	}
-	pthread_mutex_unlock(&inst->clone_mutex);
 #else
 	PERL_SET_CONTEXT(inst->perl);
 #endif
@@ -423,6 +432,10 @@ static ssize_t perl_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
 
 	}
 
+#ifdef USE_ITHREADS
+	if (interp == inst->perl) pthread_mutex_unlock(&inst->clone_mutex);
+#endif
+
 	return ret;
 }
 
@@ -539,7 +552,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	pthread_mutex_init(&inst->clone_mutex, NULL);
 
 	MEM(inst->thread_key = talloc_zero(inst, pthread_key_t));
-	rlm_perl_make_key(inst->thread_key);
+	pthread_key_create(inst->thread_key, NULL);
 #endif
 
 	/*
@@ -615,6 +628,59 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+#ifdef USE_ITHREADS
+/** Clone an interpreter for this thread
+ *
+ * Done here rather than on the first request, so the first requests on
+ * each thread don't pay for the clone.
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_perl_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_perl_t		*inst = instance;
+	rlm_perl_thread_t	*t = thread;
+
+	t->inst = inst;
+
+	pthread_mutex_lock(&inst->clone_mutex);
+	t->perl = rlm_perl_clone(inst->perl, inst->thread_key);
+	pthread_mutex_unlock(&inst->clone_mutex);
+
+	if (!t->perl) {
+		ERROR("Failed cloning perl interpreter");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Destroy this thread's interpreter
+ *
+ * @param[in] thread	specific data.
+ * @return 0.
+ */
+static int mod_thread_detach(void *thread)
+{
+	rlm_perl_thread_t	*t = thread;
+
+	if (!t->perl) return 0;
+
+	pthread_setspecific(*t->inst->thread_key, NULL);
+	rlm_destroy_perl(t->perl);
+	t->perl = NULL;
+
+	return 0;
+}
+#endif
+
 static void perl_vp_to_svpvn_element(REQUEST *request, AV *av, VALUE_PAIR const *vp,
 				     int *i, const char *hash_name, const char *list_name)
 {
@@ -820,7 +886,7 @@ static int get_hv_content(TALLOC_CTX *ctx, REQUEST *request, HV *my_hv, VALUE_PA
  * 	Store all vps in hashes %RAD_CONFIG %RAD_REPLY %RAD_REQUEST
  *
  */
-static int do_perl(void *instance, REQUEST *request, char const *function_name)
+static int do_perl(void *instance, void *thread, REQUEST *request, char const *function_name)
 {
 
 	rlm_perl_t	*inst = instance;
@@ -844,17 +910,12 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 	if (!function_name) return RLM_MODULE_FAIL;
 
 #ifdef USE_ITHREADS
-	pthread_mutex_lock(&inst->clone_mutex);
-
-	PerlInterpreter *interp;
+	rlm_perl_thread_t	*t = thread;
 
-	interp = rlm_perl_clone(inst->perl,inst->thread_key);
 	{
-		dTHXa(interp);
-		PERL_SET_CONTEXT(interp);
+		dTHXa(t->perl);
+		PERL_SET_CONTEXT(t->perl);
 	}
-
-	pthread_mutex_unlock(&inst->clone_mutex);
 #else
 	PERL_SET_CONTEXT(inst->perl);
 #endif
@@ -986,9 +1047,9 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 	return exitstatus;
 }
 
-#define RLM_PERL_FUNC(_x) static rlm_rcode_t CC_HINT(nonnull) mod_##_x(void *instance, UNUSED void *thread, REQUEST *request) \
+#define RLM_PERL_FUNC(_x) static rlm_rcode_t CC_HINT(nonnull) mod_##_x(void *instance, void *thread, REQUEST *request) \
 	{								\
-		return do_perl(instance, request,			\
+		return do_perl(instance, thread, request,		\
 			       ((rlm_perl_t const *)instance)->func_##_x); \
 	}
 
@@ -1011,7 +1072,7 @@ RLM_PERL_FUNC(preacct)
 /*
  *	Write accounting information to this modules database.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, void *thread, REQUEST *request)
 {
 	VALUE_PAIR	*pair;
 	int 		acctstatustype = 0;
@@ -1026,24 +1087,24 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 	switch (acctstatustype) {
 	case FR_STATUS_START:
 		if (((rlm_perl_t const *)instance)->func_start_accounting) {
-			return do_perl(instance, request,
+			return do_perl(instance, thread, request,
 				       ((rlm_perl_t const *)instance)->func_start_accounting);
 		} else {
-			return do_perl(instance, request,
+			return do_perl(instance, thread, request,
 				       ((rlm_perl_t const *)instance)->func_accounting);
 		}
 
 	case FR_STATUS_STOP:
 		if (((rlm_perl_t const *)instance)->func_stop_accounting) {
-			return do_perl(instance, request,
+			return do_perl(instance, thread, request,
 				       ((rlm_perl_t const *)instance)->func_stop_accounting);
 		} else {
-			return do_perl(instance, request,
+			return do_perl(instance, thread, request,
 				       ((rlm_perl_t const *)instance)->func_accounting);
 		}
 
 	default:
-		return do_perl(instance, request,
+		return do_perl(instance, thread, request,
 			       ((rlm_perl_t const *)instance)->func_accounting);
 	}
 }
@@ -1085,6 +1146,7 @@ static int mod_detach(void *instance)
 
 #ifdef USE_ITHREADS
 	rlm_perl_destruct(inst->perl);
+	pthread_key_delete(*inst->thread_key);
 	pthread_mutex_destroy(&inst->clone_mutex);
 #else
 	perl_destruct(inst->perl);
@@ -1115,15 +1177,20 @@ rad_module_t rlm_perl = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "perl",
 #ifdef USE_ITHREADS
-	.type		= RLM_TYPE_THREAD_SAFE,
+	.type		= RLM_TYPE_THREAD_SAFE | RLM_TYPE_INSTANTIATE_MAIN,
 #else
-	.type		= RLM_TYPE_THREAD_UNSAFE,
+	.type		= RLM_TYPE_THREAD_UNSAFE | RLM_TYPE_INSTANTIATE_MAIN,
 #endif
 	.inst_size	= sizeof(rlm_perl_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+#ifdef USE_ITHREADS
+	.thread_inst_size	= sizeof(rlm_perl_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
+#endif
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
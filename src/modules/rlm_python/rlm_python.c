@@ -34,6 +34,7 @@ RCSID("$Id$")
 #include <freeradius-devel/rad_assert.h>
 
 #include <Python.h>
+#include <structmember.h>
 #include <dlfcn.h>
 
 static uint32_t		python_instances = 0;
@@ -69,6 +70,9 @@ typedef struct rlm_python_t {
 						//!< FreeRADIUS functions.
 	bool		cext_compat;		//!< Whether or not to create sub-interpreters per module
 						//!< instance.
+	bool		lazy_pairs;		//!< Pass a radiusd.Request object instead of a tuple of
+						//!< request attributes.
+	PyObject	*ipaddress;		//!< The ipaddress module, if it's available.
 
 	python_func_def_t
 	instantiate,
@@ -93,6 +97,7 @@ typedef struct rlm_python_t {
  *
  * Multiple instances of python create multiple interpreters and each
  * thread must have a PyThreadState per interpreter, to track execution.
+ * This is the thread instance data of the module.
  */
 typedef struct python_thread_state {
 	PyThreadState		*state;		//!< Module instance/thread specific state.
@@ -125,6 +130,7 @@ static CONF_PARSER module_config[] = {
 
 	{ FR_CONF_OFFSET("python_path", FR_TYPE_STRING, rlm_python_t, python_path) },
 	{ FR_CONF_OFFSET("cext_compat", FR_TYPE_BOOL, rlm_python_t, cext_compat), .dflt = false },
+	{ FR_CONF_OFFSET("lazy_pairs", FR_TYPE_BOOL, rlm_python_t, lazy_pairs), .dflt = "no" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -164,11 +170,6 @@ static struct {
 	{ NULL, 0 },
 };
 
-/*
- *	This allows us to initialise PyThreadState on a per thread basis
- */
-fr_thread_local_setup(rbtree_t *, local_thread_state)	/* macro */
-
 /*
  *	radiusd Python functions
  */
@@ -335,30 +336,20 @@ static void mod_vptuple(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, PyO
 }
 
 
-/*
- *	This is the core Python function that the others wrap around.
- *	Pass the value-pair print strings in a tuple.
+/** Convert the value of an attribute to a python object
  *
- *	FIXME: We're not checking the errors. If we have errors, what
- *	do we do?
+ * @param[in] vp	to convert.
+ * @param[in] ipaddress	module.  If not NULL, IP addresses and prefixes are converted
+ *			to ipaddress objects.  Otherwise they're strings, like the other
+ *			types python has no equivalent for.
+ * @return
+ *	- A new reference.
+ *	- NULL on error, with the python exception set.
  */
-static int mod_populate_vptuple(PyObject *pp, VALUE_PAIR *vp)
+static PyObject *python_value_from_vp(VALUE_PAIR const *vp, PyObject *ipaddress)
 {
-	PyObject *attribute = NULL;
 	PyObject *value = NULL;
 
-	/* Look at the fr_pair_fprint_name? */
-
-	if (vp->da->flags.has_tag) {
-		attribute = PyString_FromFormat("%s:%d", vp->da->name, vp->tag);
-	} else {
-		attribute = PyString_FromString(vp->da->name);
-	}
-
-	if (!attribute) return -1;
-
-	PyTuple_SET_ITEM(pp, 0, attribute);
-
 	switch (vp->vp_type) {
 	case FR_TYPE_STRING:
 		value = PyUnicode_FromStringAndSize(vp->vp_strvalue, vp->vp_length);
@@ -428,15 +419,35 @@ static int mod_populate_vptuple(PyObject *pp, VALUE_PAIR *vp)
 		value = PyLong_FromUnsignedLongLong((unsigned long long)vp->vp_size);
 		break;
 
-	case FR_TYPE_TIMEVAL:
 	case FR_TYPE_IPV4_ADDR:
+	case FR_TYPE_IPV6_ADDR:
+	case FR_TYPE_IPV4_PREFIX:
+	case FR_TYPE_IPV6_PREFIX:
+		if (ipaddress) {
+			char buffer[256];
+
+			fr_pair_value_snprint(buffer, sizeof(buffer), vp, '\0');
+
+			/*
+			 *	The ipaddress module only accepts
+			 *	unicode strings in python 2.
+			 */
+			if ((vp->vp_type == FR_TYPE_IPV4_ADDR) || (vp->vp_type == FR_TYPE_IPV6_ADDR)) {
+				value = PyObject_CallMethod(ipaddress, "ip_address", "(N)",
+							    PyUnicode_FromString(buffer));
+			} else {
+				value = PyObject_CallMethod(ipaddress, "ip_network", "(NO)",
+							    PyUnicode_FromString(buffer), Py_False);
+			}
+			break;
+		}
+		/* FALL-THROUGH */
+
+	case FR_TYPE_TIMEVAL:
 	case FR_TYPE_DATE:
 	case FR_TYPE_ABINARY:
 	case FR_TYPE_IFID:
-	case FR_TYPE_IPV6_ADDR:
-	case FR_TYPE_IPV6_PREFIX:
 	case FR_TYPE_ETHERNET:
-	case FR_TYPE_IPV4_PREFIX:
 	{
 		size_t len;
 		char buffer[256];
@@ -448,9 +459,39 @@ static int mod_populate_vptuple(PyObject *pp, VALUE_PAIR *vp)
 
 	case FR_TYPE_NON_VALUES:
 		rad_assert(0);
-		return -1;
+		PyErr_SetString(PyExc_TypeError, "Attribute has no value");
+		return NULL;
+	}
+
+
+	return value;
+}
+
+/*
+ *	This is the core Python function that the others wrap around.
+ *	Pass the value-pair print strings in a tuple.
+ *
+ *	FIXME: We're not checking the errors. If we have errors, what
+ *	do we do?
+ */
+static int mod_populate_vptuple(PyObject *pp, VALUE_PAIR *vp)
+{
+	PyObject *attribute = NULL;
+	PyObject *value = NULL;
+
+	/* Look at the fr_pair_fprint_name? */
+
+	if (vp->da->flags.has_tag) {
+		attribute = PyString_FromFormat("%s:%d", vp->da->name, vp->tag);
+	} else {
+		attribute = PyString_FromString(vp->da->name);
 	}
 
+	if (!attribute) return -1;
+
+	PyTuple_SET_ITEM(pp, 0, attribute);
+
+	value = python_value_from_vp(vp, NULL);
 	if (value == NULL) return -1;
 
 	PyTuple_SET_ITEM(pp, 1, value);
@@ -458,7 +499,450 @@ static int mod_populate_vptuple(PyObject *pp, VALUE_PAIR *vp)
 	return 0;
 }
 
-static rlm_rcode_t do_python_single(REQUEST *request, PyObject *pFunc, char const *funcname)
+/** A list of attributes in a request, as seen by python
+ *
+ * Attributes are only converted to python objects when the script asks
+ * for them, and updates are made to the list directly.
+ */
+typedef struct {
+	PyObject_HEAD
+	REQUEST		*request;		//!< The list belongs to.  NULL once the function has returned.
+	pair_lists_t	list;			//!< Which list of the request this is.
+	PyObject	*ipaddress;		//!< The ipaddress module, or NULL.  Borrowed from the instance.
+} python_pair_list_t;
+
+/** The request passed to python functions when lazy_pairs is enabled
+ *
+ */
+typedef struct {
+	PyObject_HEAD
+	PyObject	*request;		//!< radiusd.PairList for the request list.
+	PyObject	*reply;			//!< radiusd.PairList for the reply list.
+	PyObject	*control;		//!< radiusd.PairList for the control list.
+	PyObject	*state;			//!< radiusd.PairList for the session-state list.
+} python_request_t;
+
+/** Find the list a python_pair_list_t refers to
+ *
+ * @return
+ *	- The head of the list.
+ *	- NULL with the python exception set, if the list is no longer valid.
+ */
+static VALUE_PAIR **python_pair_list_head(python_pair_list_t *self)
+{
+	VALUE_PAIR **head;
+
+	if (!self->request) {
+		PyErr_SetString(PyExc_RuntimeError, "Request is no longer valid");
+		return NULL;
+	}
+
+	head = radius_list(self->request, self->list);
+	if (!head) {
+		PyErr_Format(PyExc_RuntimeError, "List %s is not available",
+			     fr_int2str(pair_lists, self->list, "<INVALID>"));
+		return NULL;
+	}
+
+	return head;
+}
+
+/** Find the dictionary attribute for a python string
+ *
+ * @return
+ *	- The attribute.
+ *	- NULL with the python exception set.
+ */
+static fr_dict_attr_t const *python_attr_find(PyObject *key)
+{
+	fr_dict_attr_t const	*da;
+	char const		*name;
+
+	if (!PyString_Check(key)) {
+		PyErr_SetString(PyExc_TypeError, "Attribute name must be a string");
+		return NULL;
+	}
+	name = PyString_AsString(key);
+
+	da = fr_dict_attr_by_name(NULL, name);
+	if (!da) {
+		PyErr_Format(PyExc_KeyError, "Unknown attribute %s", name);
+		return NULL;
+	}
+
+	return da;
+}
+
+/** Set the value of an attribute from a python object
+ *
+ * Strings are parsed as the type of the attribute.  Other objects are
+ * converted to strings first, so ints and ipaddress objects work too.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, with the python exception set.
+ */
+static int python_value_to_vp(VALUE_PAIR *vp, PyObject *value)
+{
+	PyObject	*str;
+
+	if (PyBool_Check(value)) {
+		str = PyString_FromString((value == Py_True) ? "yes" : "no");
+
+	} else if (PyString_Check(value)) {
+		if (vp->vp_type == FR_TYPE_OCTETS) {
+			fr_pair_value_memcpy(vp, (uint8_t const *)PyString_AS_STRING(value), PyString_GET_SIZE(value));
+			return 0;
+		}
+		Py_INCREF(value);
+		str = value;
+
+	} else if (PyUnicode_Check(value)) {
+		str = PyUnicode_AsUTF8String(value);
+
+	} else {
+		str = PyObject_Str(value);
+	}
+	if (!str) return -1;
+
+	if (fr_pair_value_from_str(vp, PyString_AS_STRING(str), PyString_GET_SIZE(str)) < 0) {
+		PyErr_Format(PyExc_ValueError, "Invalid value for %s: %s", vp->da->name, fr_strerror());
+		Py_DECREF(str);
+		return -1;
+	}
+	Py_DECREF(str);
+
+	return 0;
+}
+
+/** Update cached copies of request attributes after the request list changes
+ *
+ */
+static void python_pair_list_updated(python_pair_list_t *self)
+{
+	REQUEST *request = self->request;
+
+	if (self->list != PAIR_LIST_REQUEST) return;
+
+	request->username = fr_pair_find_by_num(request->packet->vps, 0, FR_USER_NAME, TAG_ANY);
+	request->password = fr_pair_find_by_num(request->packet->vps, 0, FR_USER_PASSWORD, TAG_ANY);
+	if (!request->password) request->password = fr_pair_find_by_num(request->packet->vps, 0,
+									FR_CHAP_PASSWORD, TAG_ANY);
+}
+
+static Py_ssize_t python_pair_list_length(PyObject *obj)
+{
+	python_pair_list_t	*self = (python_pair_list_t *)obj;
+	VALUE_PAIR		**head, *vp;
+	vp_cursor_t		cursor;
+	Py_ssize_t		count = 0;
+
+	head = python_pair_list_head(self);
+	if (!head) return -1;
+
+	for (vp = fr_pair_cursor_init(&cursor, head); vp; vp = fr_pair_cursor_next(&cursor)) count++;
+
+	return count;
+}
+
+/** Return the value of the first instance of an attribute
+ *
+ */
+static PyObject *python_pair_list_getitem(PyObject *obj, PyObject *key)
+{
+	python_pair_list_t	*self = (python_pair_list_t *)obj;
+	VALUE_PAIR		**head, *vp;
+	fr_dict_attr_t const	*da;
+
+	head = python_pair_list_head(self);
+	if (!head) return NULL;
+
+	da = python_attr_find(key);
+	if (!da) return NULL;
+
+	vp = fr_pair_find_by_da(*head, da, TAG_ANY);
+	if (!vp) {
+		PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+
+	return python_value_from_vp(vp, self->ipaddress);
+}
+
+/** Set the value of the first instance of an attribute, or delete all instances of it
+ *
+ */
+static int python_pair_list_setitem(PyObject *obj, PyObject *key, PyObject *value)
+{
+	python_pair_list_t	*self = (python_pair_list_t *)obj;
+	VALUE_PAIR		**head, *vp;
+	fr_dict_attr_t const	*da;
+
+	head = python_pair_list_head(self);
+	if (!head) return -1;
+
+	da = python_attr_find(key);
+	if (!da) return -1;
+
+	if (!value) {
+		fr_pair_delete_by_num(head, da->vendor, da->attr, TAG_ANY);
+		python_pair_list_updated(self);
+		return 0;
+	}
+
+	vp = fr_pair_find_by_da(*head, da, TAG_ANY);
+	if (vp) {
+		if (python_value_to_vp(vp, value) < 0) return -1;
+	} else {
+		vp = fr_pair_afrom_da(radius_list_ctx(self->request, self->list), da);
+		if (!vp) {
+			PyErr_NoMemory();
+			return -1;
+		}
+
+		if (python_value_to_vp(vp, value) < 0) {
+			talloc_free(vp);
+			return -1;
+		}
+		fr_pair_add(head, vp);
+	}
+	python_pair_list_updated(self);
+
+	return 0;
+}
+
+static int python_pair_list_contains(PyObject *obj, PyObject *key)
+{
+	python_pair_list_t	*self = (python_pair_list_t *)obj;
+	VALUE_PAIR		**head;
+	fr_dict_attr_t const	*da;
+
+	head = python_pair_list_head(self);
+	if (!head) return -1;
+
+	da = python_attr_find(key);
+	if (!da) {
+		if (!PyErr_ExceptionMatches(PyExc_KeyError)) return -1;
+		PyErr_Clear();
+		return 0;
+	}
+
+	return (fr_pair_find_by_da(*head, da, TAG_ANY) != NULL);
+}
+
+/** radiusd.PairList.get(name, default=None)
+ *
+ */
+static PyObject *python_pair_list_get(PyObject *obj, PyObject *args)
+{
+	PyObject	*key, *dflt = Py_None, *value;
+
+	if (!PyArg_ParseTuple(args, "O|O", &key, &dflt)) return NULL;
+
+	value = python_pair_list_getitem(obj, key);
+	if (value || !PyErr_ExceptionMatches(PyExc_KeyError)) return value;
+
+	PyErr_Clear();
+	Py_INCREF(dflt);
+
+	return dflt;
+}
+
+/** radiusd.PairList.getall(name)
+ *
+ */
+static PyObject *python_pair_list_getall(PyObject *obj, PyObject *args)
+{
+	python_pair_list_t	*self = (python_pair_list_t *)obj;
+	PyObject		*key, *values;
+	VALUE_PAIR		**head, *vp;
+	fr_dict_attr_t const	*da;
+	vp_cursor_t		cursor;
+
+	if (!PyArg_ParseTuple(args, "O", &key)) return NULL;
+
+	head = python_pair_list_head(self);
+	if (!head) return NULL;
+
+	da = python_attr_find(key);
+	if (!da) return NULL;
+
+	values = PyList_New(0);
+	if (!values) return NULL;
+
+	fr_pair_cursor_init(&cursor, head);
+	while ((vp = fr_pair_cursor_next_by_da(&cursor, da, TAG_ANY))) {
+		PyObject *value;
+
+		value = python_value_from_vp(vp, self->ipaddress);
+		if (!value || (PyList_Append(values, value) < 0)) {
+			Py_XDECREF(value);
+			Py_DECREF(values);
+			return NULL;
+		}
+		Py_DECREF(value);
+	}
+
+	return values;
+}
+
+/** radiusd.PairList.keys()
+ *
+ */
+static PyObject *python_pair_list_keys(PyObject *obj, UNUSED PyObject *args)
+{
+	python_pair_list_t	*self = (python_pair_list_t *)obj;
+	PyObject		*keys;
+	VALUE_PAIR		**head, *vp;
+	vp_cursor_t		cursor;
+
+	head = python_pair_list_head(self);
+	if (!head) return NULL;
+
+	keys = PyList_New(0);
+	if (!keys) return NULL;
+
+	for (vp = fr_pair_cursor_init(&cursor, head); vp; vp = fr_pair_cursor_next(&cursor)) {
+		PyObject *name;
+
+		name = PyString_FromString(vp->da->name);
+		if (!name || (PyList_Append(keys, name) < 0)) {
+			Py_XDECREF(name);
+			Py_DECREF(keys);
+			return NULL;
+		}
+		Py_DECREF(name);
+	}
+
+	return keys;
+}
+
+static PyMappingMethods python_pair_list_mapping = {
+	.mp_length		= python_pair_list_length,
+	.mp_subscript		= python_pair_list_getitem,
+	.mp_ass_subscript	= python_pair_list_setitem,
+};
+
+static PySequenceMethods python_pair_list_sequence = {
+	.sq_contains		= python_pair_list_contains,
+};
+
+static PyMethodDef python_pair_list_methods[] = {
+	{ "get", &python_pair_list_get, METH_VARARGS,
+	  "get(name, default=None)\n\n" \
+	  "Return the value of the first instance of an attribute, or default.\n"
+	},
+	{ "getall", &python_pair_list_getall, METH_VARARGS,
+	  "getall(name)\n\n" \
+	  "Return a list of the values of every instance of an attribute.\n"
+	},
+	{ "keys", &python_pair_list_keys, METH_NOARGS,
+	  "keys()\n\n" \
+	  "Return a list of the names of the attributes in the list.\n"
+	},
+	{ NULL, NULL, 0, NULL },
+};
+
+static PyTypeObject python_pair_list_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name		= "radiusd.PairList",
+	.tp_basicsize		= sizeof(python_pair_list_t),
+	.tp_flags		= Py_TPFLAGS_DEFAULT,
+	.tp_doc			= "A list of attributes in a request",
+	.tp_as_mapping		= &python_pair_list_mapping,
+	.tp_as_sequence		= &python_pair_list_sequence,
+	.tp_methods		= python_pair_list_methods,
+};
+
+static void python_request_dealloc(PyObject *obj)
+{
+	python_request_t *self = (python_request_t *)obj;
+
+	Py_XDECREF(self->request);
+	Py_XDECREF(self->reply);
+	Py_XDECREF(self->control);
+	Py_XDECREF(self->state);
+
+	Py_TYPE(obj)->tp_free(obj);
+}
+
+static PyMemberDef python_request_members[] = {
+	{ "request", T_OBJECT_EX, offsetof(python_request_t, request), READONLY, "The request list" },
+	{ "reply", T_OBJECT_EX, offsetof(python_request_t, reply), READONLY, "The reply list" },
+	{ "control", T_OBJECT_EX, offsetof(python_request_t, control), READONLY, "The control list" },
+	{ "state", T_OBJECT_EX, offsetof(python_request_t, state), READONLY, "The session-state list" },
+	{ NULL, 0, 0, 0, NULL },
+};
+
+static PyTypeObject python_request_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name		= "radiusd.Request",
+	.tp_basicsize		= sizeof(python_request_t),
+	.tp_dealloc		= python_request_dealloc,
+	.tp_flags		= Py_TPFLAGS_DEFAULT,
+	.tp_doc			= "The request being processed",
+	.tp_members		= python_request_members,
+};
+
+static PyObject *python_pair_list_alloc(REQUEST *request, pair_lists_t list, PyObject *ipaddress)
+{
+	python_pair_list_t *self;
+
+	self = PyObject_New(python_pair_list_t, &python_pair_list_type);
+	if (!self) return NULL;
+
+	self->request = request;
+	self->list = list;
+	self->ipaddress = ipaddress;
+
+	return (PyObject *)self;
+}
+
+/** Wrap a request for passing to a python function
+ *
+ * @param[in] inst	of rlm_python.
+ * @param[in] request	to wrap.
+ * @return
+ *	- A new radiusd.Request.
+ *	- NULL on error.
+ */
+static PyObject *python_request_alloc(rlm_python_t const *inst, REQUEST *request)
+{
+	python_request_t *self;
+
+	self = PyObject_New(python_request_t, &python_request_type);
+	if (!self) return NULL;
+
+	self->request = python_pair_list_alloc(request, PAIR_LIST_REQUEST, inst->ipaddress);
+	self->reply = python_pair_list_alloc(request, PAIR_LIST_REPLY, inst->ipaddress);
+	self->control = python_pair_list_alloc(request, PAIR_LIST_CONTROL, inst->ipaddress);
+	self->state = python_pair_list_alloc(request, PAIR_LIST_STATE, inst->ipaddress);
+
+	if (!self->request || !self->reply || !self->control || !self->state) {
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	return (PyObject *)self;
+}
+
+/** Stop a radiusd.Request from accessing the request
+ *
+ * The script may keep references to the object after the function returns,
+ * so it must not point to the request any more.
+ */
+static void python_request_invalidate(PyObject *obj)
+{
+	python_request_t *self = (python_request_t *)obj;
+
+	((python_pair_list_t *)self->request)->request = NULL;
+	((python_pair_list_t *)self->reply)->request = NULL;
+	((python_pair_list_t *)self->control)->request = NULL;
+	((python_pair_list_t *)self->state)->request = NULL;
+}
+
+static rlm_rcode_t do_python_single(rlm_python_t const *inst, REQUEST *request, PyObject *pFunc,
+				    char const *funcname)
 {
 	vp_cursor_t	cursor;
 	VALUE_PAIR      *vp;
@@ -466,10 +950,24 @@ static rlm_rcode_t do_python_single(REQUEST *request, PyObject *pFunc, char cons
 	PyObject	*pArgs = NULL;
 	int		tuplelen;
 	int		ret;
+	bool		lazy = (request && inst->lazy_pairs);
 
 	/* Default return value is "OK, continue" */
 	ret = RLM_MODULE_OK;
 
+	/*
+	 *	Pass an object which converts attributes as
+	 *	they're accessed.
+	 */
+	if (lazy) {
+		pArgs = python_request_alloc(inst, request);
+		if (!pArgs) {
+			ret = RLM_MODULE_FAIL;
+			goto finish;
+		}
+		goto call;
+	}
+
 	/*
 	 *	We will pass a tuple containing (name, value) tuples
 	 *	We can safely use the Python function to build up a
@@ -517,6 +1015,7 @@ static rlm_rcode_t do_python_single(REQUEST *request, PyObject *pFunc, char cons
 		}
 	}
 
+call:
 	/* Call Python function. */
 	pRet = PyObject_CallFunctionObjArgs(pFunc, pArgs, NULL);
 	if (!pRet) {
@@ -583,6 +1082,7 @@ static rlm_rcode_t do_python_single(REQUEST *request, PyObject *pFunc, char cons
 
 
 finish:
+	if (lazy && pArgs) python_request_invalidate(pArgs);
 	Py_XDECREF(pArgs);
 	Py_XDECREF(pRet);
 
@@ -597,125 +1097,32 @@ static void python_interpreter_free(PyThreadState *interp)
 	PyEval_ReleaseLock();
 }
 
-/** Destroy a thread state
- *
- * @param thread to destroy.
- * @return 0
- */
-static int _python_thread_free(python_thread_state_t *thread)
-{
-	PyEval_RestoreThread(thread->state);	/* Swap in our local thread state */
-	PyThreadState_Clear(thread->state);
-	PyEval_SaveThread();
-
-	PyThreadState_Delete(thread->state);	/* Don't need to hold lock for this */
-
-	return 0;
-}
-
-/** Callback for rbtree delete walker
- *
- */
-static void _python_thread_entry_free(void *arg)
-{
-	talloc_free(arg);
-}
-
-/** Cleanup any thread local storage on pthread_exit()
- *
- * @param arg The thread currently exiting.
- */
-static void _python_thread_tree_free(void *arg)
-{
-	rad_assert(arg == local_thread_state);
-
-	rbtree_t *tree = talloc_get_type_abort(arg, rbtree_t);
-	talloc_free(tree);	/* Needs to be this not talloc_free to execute delete walker */
-
-	local_thread_state = NULL;	/* Prevent double free in unit_test_module env */
-}
-
-/** Compare instance pointers
- *
- */
-static int _python_inst_cmp(const void *a, const void *b)
-{
-	python_thread_state_t const *a_p = a, *b_p = b;
-
-	return (a_p->inst < b_p->inst) - (a_p->inst > b_p->inst);
-}
-
 /** Thread safe call to a python function
  *
  * Will swap in thread state specific to module/thread.
  */
-static rlm_rcode_t do_python(rlm_python_t const *inst, REQUEST *request, PyObject *pFunc, char const *funcname)
+static rlm_rcode_t do_python(python_thread_state_t *this_thread, REQUEST *request, PyObject *pFunc,
+			     char const *funcname)
 {
 	int			ret;
-	rbtree_t		*thread_tree;
-	python_thread_state_t	*this_thread;
-	python_thread_state_t	find;
 
 	/*
 	 *	It's a NOOP if the function wasn't defined
 	 */
 	if (!pFunc) return RLM_MODULE_NOOP;
 
-	/*
-	 *	Check to see if we've got a thread state tree
-	 *	If not, create one.
-	 */
-	thread_tree = local_thread_state;
-	if (!thread_tree) {
-		thread_tree = rbtree_create(NULL, _python_inst_cmp, _python_thread_entry_free, 0);
-		if (!thread_tree) {
-			RERROR("Failed allocating thread state tree");
-			return RLM_MODULE_FAIL;
-		}
-		fr_thread_local_set_destructor(local_thread_state, _python_thread_tree_free, thread_tree);
-	}
-
-	find.inst = inst;
-	/*
-	 *	Find the thread state associated with this instance
-	 *	and this thread, or create a new thread state.
-	 */
-	this_thread = rbtree_finddata(thread_tree, &find);
-	if (!this_thread) {
-		PyThreadState *state;
-
-		state = PyThreadState_New(inst->sub_interpreter->interp);
-
-		RDEBUG3("Initialised new thread state %p", state);
-		if (!state) {
-			REDEBUG("Failed initialising local PyThreadState on first run");
-			return RLM_MODULE_FAIL;
-		}
-
-		this_thread = talloc(NULL, python_thread_state_t);
-		this_thread->inst = inst;
-		this_thread->state = state;
-		talloc_set_destructor(this_thread, _python_thread_free);
-
-		if (!rbtree_insert(thread_tree, this_thread)) {
-			RERROR("Failed inserting thread state into TLS tree");
-			talloc_free(this_thread);
-
-			return RLM_MODULE_FAIL;
-		}
-	}
 	RDEBUG3("Using thread state %p", this_thread->state);
 
 	PyEval_RestoreThread(this_thread->state);	/* Swap in our local thread state */
-	ret = do_python_single(request, pFunc, funcname);
+	ret = do_python_single(this_thread->inst, request, pFunc, funcname);
 	PyEval_SaveThread();
 
 	return ret;
 }
 
 #define MOD_FUNC(x) \
-static rlm_rcode_t CC_HINT(nonnull) mod_##x(void *instance, UNUSED void *thread, REQUEST *request) { \
-	return do_python((rlm_python_t const *) instance, request, ((rlm_python_t const *)instance)->x.function, #x);\
+static rlm_rcode_t CC_HINT(nonnull) mod_##x(void *instance, void *thread, REQUEST *request) { \
+	return do_python(thread, request, ((rlm_python_t const *)instance)->x.function, #x);\
 }
 
 MOD_FUNC(authenticate)
@@ -964,6 +1371,18 @@ static int python_interpreter_init(rlm_python_t *inst, CONF_SECTION *conf)
 				goto error;
 		}
 
+		/*
+		 *	Types passed to functions when lazy_pairs is
+		 *	enabled.  PyModule_AddObject steals a reference.
+		 */
+		if ((PyType_Ready(&python_pair_list_type) < 0) ||
+		    (PyType_Ready(&python_request_type) < 0)) goto error;
+
+		Py_INCREF(&python_pair_list_type);
+		if (PyModule_AddObject(inst->module, "PairList", (PyObject *)&python_pair_list_type) < 0) goto error;
+		Py_INCREF(&python_request_type);
+		if (PyModule_AddObject(inst->module, "Request", (PyObject *)&python_request_type) < 0) goto error;
+
 		/*
 		 *	Convert a FreeRADIUS config structure into a python
 		 *	dictionary.
@@ -1041,10 +1460,22 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 #endif
 	PYTHON_FUNC_LOAD(detach);
 
+	/*
+	 *	Used to pass IP addresses to functions as objects,
+	 *	rather than strings.
+	 */
+	if (inst->lazy_pairs) {
+		inst->ipaddress = PyImport_ImportModule("ipaddress");
+		if (!inst->ipaddress) {
+			PyErr_Clear();
+			WARN("Python module 'ipaddress' is not available, IP addresses will be passed as strings");
+		}
+	}
+
 	/*
 	 *	Call the instantiate function.
 	 */
-	code = do_python_single(NULL, inst->instantiate.function, "instantiate");
+	code = do_python_single(inst, NULL, inst->instantiate.function, "instantiate");
 	if (code < 0) {
 	error:
 		python_error_log();	/* Needs valid thread with GIL */
@@ -1056,6 +1487,59 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+/** Create a thread state for this thread
+ *
+ * Done here rather than on the first request, so the first requests on
+ * each thread don't pay for it.  The module was imported into the
+ * interpreter by mod_instantiate, and is shared by all threads.
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_python_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_python_t const	*inst = instance;
+	python_thread_state_t	*this_thread = thread;
+
+	this_thread->inst = inst;
+	this_thread->state = PyThreadState_New(inst->sub_interpreter->interp);
+	if (!this_thread->state) {
+		ERROR("Failed initialising local PyThreadState");
+		return -1;
+	}
+
+	DEBUG3("Initialised new thread state %p", this_thread->state);
+
+	return 0;
+}
+
+/** Destroy this thread's thread state
+ *
+ * @param[in] thread	specific data.
+ * @return 0.
+ */
+static int mod_thread_detach(void *thread)
+{
+	python_thread_state_t	*this_thread = thread;
+
+	if (!this_thread->state) return 0;
+
+	PyEval_RestoreThread(this_thread->state);	/* Swap in our local thread state */
+	PyThreadState_Clear(this_thread->state);
+	PyEval_SaveThread();
+
+	PyThreadState_Delete(this_thread->state);	/* Don't need to hold lock for this */
+	this_thread->state = NULL;
+
+	return 0;
+}
+
 static int mod_detach(void *instance)
 {
 	rlm_python_t *inst = instance;
@@ -1066,7 +1550,7 @@ static int mod_detach(void *instance)
 	 */
 	PyEval_RestoreThread(inst->sub_interpreter);
 
-	ret = do_python_single(NULL, inst->detach.function, "detach");
+	ret = do_python_single(inst, NULL, inst->detach.function, "detach");
 
 #define PYTHON_FUNC_DESTROY(_x) python_function_destroy(&inst->_x)
 	PYTHON_FUNC_DESTROY(instantiate);
@@ -1078,18 +1562,10 @@ static int mod_detach(void *instance)
 
 	Py_DecRef(inst->pythonconf_dict);
 	Py_DecRef(inst->module);
+	Py_XDECREF(inst->ipaddress);
 
 	PyEval_SaveThread();
 
-	/*
-	 *	Force cleaning up of threads if this is *NOT* a worker
-	 *	thread, which happens if this is being called from
-	 *	unit_test_module framework, and probably with the server running
-	 *	in debug mode.
-	 */
-	talloc_free(local_thread_state);
-	local_thread_state = NULL;
-
 	/*
 	 *	Only destroy if it's a subinterpreter
 	 */
@@ -1121,13 +1597,16 @@ static int mod_detach(void *instance)
  */
 extern rad_module_t rlm_python;
 rad_module_t rlm_python = {
-	.magic		= RLM_MODULE_INIT,
-	.name		= "python",
-	.type		= RLM_TYPE_THREAD_SAFE,
-	.inst_size	= sizeof(rlm_python_t),
-	.config		= module_config,
-	.instantiate	= mod_instantiate,
-	.detach		= mod_detach,
+	.magic			= RLM_MODULE_INIT,
+	.name			= "python",
+	.type			= RLM_TYPE_THREAD_SAFE | RLM_TYPE_INSTANTIATE_MAIN,
+	.inst_size		= sizeof(rlm_python_t),
+	.thread_inst_size	= sizeof(python_thread_state_t),
+	.config			= module_config,
+	.instantiate		= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.detach			= mod_detach,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
@@ -1 +1 @@
-SUBMAKEFILES := rlm_radius.mk
+SUBMAKEFILES := rlm_radius.mk rlm_radius_udp.mk rlm_radius_tcp.mk
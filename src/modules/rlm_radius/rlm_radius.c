@@ -27,38 +27,181 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/atomic_queue.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/metrics.h>
+#include <freeradius-devel/io/trace.h>
+#include <freeradius-devel/net.h>
+#include <freeradius-devel/probe.h>
+#include <freeradius-devel/radius/radius.h>
 #include <freeradius-devel/rad_assert.h>
 
 #include "rlm_radius.h"
+#include "spool.h"
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#include <pthread.h>
 
 static int transport_parse(TALLOC_CTX *ctx, void *out, CONF_ITEM *ci, CONF_PARSER const *rule);
 
+/*
+ *	The number of RADIUS IDs available on one source port.
+ */
+#define RLM_RADIUS_MAX_IDS	256
+
+/*
+ *	The most packets we read or write with one system call.
+ */
+#define RLM_RADIUS_BATCH_MAX	64
+
+/*
+ *	Weight of a new sample in the moving average of response times,
+ *	as a shift.  Each sample counts for 1/8, as with TCP's SRTT.
+ */
+#define RLM_RADIUS_RTT_SHIFT	3
+
+/*
+ *	How often we recalculate the hedge delay, in replies, and how
+ *	many replies the histogram holds before it's cleared.
+ */
+#define RLM_RADIUS_HEDGE_UPDATE		64
+#define RLM_RADIUS_HEDGE_WINDOW		16384
+
+/*
+ *	The most hedged requests we send in a burst, no matter how
+ *	much budget has built up.
+ */
+#define RLM_RADIUS_HEDGE_BURST		10
+
+/*
+ *	The most requests each worker can have outstanding with the
+ *	shared I/O thread, and the most which can be waiting for the
+ *	I/O thread to pick them up.
+ */
+#define RLM_RADIUS_SHARED_MAX_WORKER	4096
+#define RLM_RADIUS_SHARED_MAX		65536
+
+/*
+ *	How often the replication thread sends packets, and how often
+ *	it retries opening a connection to a collector.
+ */
+#define RLM_RADIUS_REPLICATE_INTERVAL	(NANOSEC / 100)
+#define RLM_RADIUS_REPLICATE_REOPEN	NANOSEC
+
+typedef enum {
+	RLM_RADIUS_MODE_INVALID = 0,
+	RLM_RADIUS_MODE_PROXY,				//!< Wait for the home server to reply.
+	RLM_RADIUS_MODE_REPLICATE			//!< Queue a copy for every home server, and don't wait.
+} rlm_radius_mode_t;
+
+static FR_NAME_NUMBER const mode_table[] = {
+	{ "proxy",		RLM_RADIUS_MODE_PROXY		},
+	{ "replicate",		RLM_RADIUS_MODE_REPLICATE	},
+
+	{  NULL , -1 }
+};
+
+typedef enum {
+	RLM_RADIUS_HEDGE_INVALID = 0,
+	RLM_RADIUS_HEDGE_NONE,				//!< Send each request to one home server.
+	RLM_RADIUS_HEDGE_DELAYED,			//!< Send a copy if the first home server is slow.
+	RLM_RADIUS_HEDGE_IMMEDIATE			//!< Send to two home servers at once.
+} rlm_radius_hedge_t;
+
+static FR_NAME_NUMBER const hedge_mode_table[] = {
+	{ "none",		RLM_RADIUS_HEDGE_NONE		},
+	{ "delayed",		RLM_RADIUS_HEDGE_DELAYED	},
+	{ "immediate",		RLM_RADIUS_HEDGE_IMMEDIATE	},
+
+	{  NULL , -1 }
+};
+
+/** A home server, one per transport section
+ *
+ */
+typedef struct {
+	char const		*name;		//!< Name of the transport section.
+	void			*client_io_instance; //!< Easy access to the client_io instance
+	CONF_SECTION		*client_io_conf;  //!< Easy access to the client_io's config section
+} rlm_radius_home_server_t;
+
 /*
  *	Define a structure for our module configuration.
  */
 typedef struct radius_instance {
 	char const		*name;		//!< Module instance name.
 
+	char const		*secret;	//!< Shared secret for the home server.
+	size_t			secret_len;
+
+	char const		*mode_str;	//!< Whether we proxy or replicate.
+	rlm_radius_mode_t	mode;
+
 	struct timeval		connection_timeout;
 	struct timeval		reconnection_delay;
 	struct timeval		idle_timeout;
-
-	dl_instance_t		*io_submodule;	//!< As provided by the transport_parse
+	struct timeval		response_timeout;
+
+	uint32_t		min_connections;	//!< Connections each thread keeps open.
+	uint32_t		max_connections;	//!< Most connections each thread may open.
+	uint32_t		spare_ids;		//!< Open another connection when fewer
+							//!< IDs than this are free.
+	bool			shared_connections;	//!< Workers share connections owned by one
+							//!< I/O thread.
+
+	struct timeval		zombie_period;		//!< No replies for this long marks a connection zombie.
+	fr_time_t		zombie_period_time;	//!< zombie_period, as an fr_time_t.
+	uint32_t		max_unanswered;		//!< Or this many requests timing out in a row.
+	struct timeval		check_interval;		//!< First delay between Status-Server probes.
+	struct timeval		max_check_interval;	//!< Probes back off to this delay.
+	uint32_t		num_answers_to_alive;	//!< Answered probes needed to revive a connection.
+
+	char const		*hedge_mode_str;	//!< How we hedge requests.
+	rlm_radius_hedge_t	hedge_mode;
+	uint32_t		hedge_percentile;	//!< Hedge when there's no reply by this percentile.
+	uint32_t		hedge_max_load;		//!< Most extra requests from hedging, as a percentage.
+
+	dl_instance_t		**io_submodule;	//!< One per home server, as provided by transport_parse
 	fr_radius_client_io_t	*client_io;	//!< Easy access to the client_io handle
-	void			*client_io_instance; //!< Easy access to the client_io instance
-	CONF_SECTION		*client_io_conf;  //!< Easy access to the client_io's config section
+
+	rlm_radius_home_server_t *home_servers;	//!< Where we send packets.
+	uint32_t		num_home_servers;
+
+	struct rlm_radius_shared_t *shared;	//!< The I/O thread, if connections are shared.
+
+	uint32_t		replicate_queue_size;	//!< Packets queued for each collector.
+	uint32_t		replicate_max_rate;	//!< Packets per second to each collector, or 0.
+	struct rlm_radius_replicate_t *replicate; //!< The replication thread.
+
+	char const		*spool_directory;	//!< Where accounting packets are spooled, or NULL.
+	size_t			spool_segment_size;	//!< Size of each spool file.
+	size_t			spool_max_size;		//!< Most disk space the spool may use.
+	bool			spool_sync;		//!< Write each packet to disk before returning.
+	uint32_t		spool_max_rate;		//!< Packets per second to replay, or 0.
+	uint32_t		spool_window;		//!< Spooled packets waiting for replies at once.
+	radius_spool_t		*spool;			//!< Packets no home server answered.
+	struct rlm_radius_replay_t *replay;		//!< The thread which replays the spool.
 } rlm_radius_t;
 
 typedef struct rlm_radius_connection_t rlm_radius_connection_t;
+typedef struct rlm_radius_thread_t rlm_radius_thread_t;
+typedef struct rlm_radius_worker_t rlm_radius_worker_t;
+typedef struct rlm_radius_shared_t rlm_radius_shared_t;
+typedef struct rlm_radius_replicate_t rlm_radius_replicate_t;
+typedef struct rlm_radius_replay_t rlm_radius_replay_t;
 
-
-/** Per-thread instance data
+/** Per-thread data for one home server
  *
- * Contains buffers and connection handles specific to the thread.
+ * Each thread has its own connections to each home server.
  */
 typedef struct {
-	rlm_radius_t const	*inst;			//!< Instance of the module.
-	fr_event_list_t		*el;			//!< This thread's event list.
+	rlm_radius_home_server_t const *home_server;	//!< The home server this is for.
+	rlm_radius_thread_t	*thread;		//!< thread instance
 
 	bool			pending;		//!< We have pending messages to write.
 	fr_dlist_t		queued;			//!< re-queued when a connection fails
@@ -66,7 +209,235 @@ typedef struct {
 	fr_dlist_t		active;			//!< list of connected sockets
 	fr_dlist_t		frozen;			//!< list of zombie sockets... not quite dead
 	fr_dlist_t		closed;			//!< list of closed sockets
-} rlm_radius_thread_t;
+
+	uint32_t		num_connections;	//!< Connections in any list.
+	uint32_t		num_zombie;		//!< Connections which are zombie.
+	uint32_t		num_free;		//!< Free IDs on active connections.
+
+	uint32_t		outstanding;		//!< Requests queued for, or sent to the home server.
+	fr_time_t		rtt;			//!< Moving average of the response time.
+
+	fr_time_t		hedge_delay;		//!< Send a hedged request after this long.
+	fr_time_histogram_t	histogram;		//!< Response times, for the hedge delay.
+
+	fr_metric_set_t		*metrics;		//!< Counters for the metrics endpoint.  May be NULL.
+} rlm_radius_home_t;
+
+/*
+ *	The metrics for each home server, in each thread.
+ */
+typedef enum {
+	HOME_METRIC_REQUESTS = 0,
+	HOME_METRIC_RESPONSES,
+	HOME_METRIC_TIMEOUTS,
+	HOME_METRIC_LATENCY,
+	HOME_METRIC_MAX
+} rlm_radius_home_metric_t;
+
+static fr_metric_t const home_metrics[HOME_METRIC_MAX] = {
+	[HOME_METRIC_REQUESTS] = { "freeradius_home_server_requests", NULL, FR_METRIC_COUNTER,
+				   "Requests proxied to the home server." },
+	[HOME_METRIC_RESPONSES] = { "freeradius_home_server_responses", NULL, FR_METRIC_COUNTER,
+				    "Responses received from the home server." },
+	[HOME_METRIC_TIMEOUTS] = { "freeradius_home_server_timeouts", NULL, FR_METRIC_COUNTER,
+				   "Requests which the home server didn't answer in time." },
+	[HOME_METRIC_LATENCY] = { "freeradius_home_server_latency_seconds", NULL, FR_METRIC_HISTOGRAM,
+				  "Time from sending a request to the home server, to its response." },
+};
+
+/** Per-thread instance data
+ *
+ * Contains buffers and connection handles specific to the thread.
+ */
+struct rlm_radius_thread_t {
+	rlm_radius_t const	*inst;			//!< Instance of the module.
+	fr_event_list_t		*el;			//!< This thread's event list.
+
+	rlm_radius_home_t	*home;			//!< One per home server.
+
+	uint8_t			*rx_buffer;		//!< RLM_RADIUS_BATCH_MAX packets, for read_batch.
+
+	uint32_t		hedge_budget;		//!< Hundredths of a hedged request we can send.
+
+	rlm_radius_worker_t	*worker;		//!< Our replies from the shared I/O thread.
+
+	fr_hash_table_t		*inflight;		//!< Requests we're proxying, by rlm_radius_key_t.
+};
+
+/** Identifies a request from the NAS
+ *
+ * A retransmission has the same key as the original request, no
+ * matter which listener or worker it arrives on.
+ */
+typedef struct {
+	fr_ipaddr_t		src_ipaddr;		//!< Of the NAS.
+	uint16_t		src_port;
+	uint8_t			code;
+	uint8_t			id;
+	uint8_t			vector[AUTH_VECTOR_LEN];
+} rlm_radius_key_t;
+
+/** A request which a worker has handed to the shared I/O thread
+ *
+ * The worker owns it until it's pushed to the I/O thread, and the
+ * I/O thread owns it until it's pushed back.  The only field which
+ * both threads touch is "cancelled".
+ */
+typedef struct {
+	rlm_radius_worker_t	*worker;		//!< Where the reply goes.
+	struct rlm_radius_link_t *link;			//!< The worker's link.  Only the worker uses this.
+	atomic_bool		cancelled;		//!< The worker doesn't want the reply.
+
+	fr_dlist_t		entry;			//!< In the I/O thread's list of replies to return.
+	char const		*name;			//!< Where the I/O thread sent it, for debug messages.
+
+	uint8_t			*packet;		//!< Encoded by the worker, with ID 0.
+	size_t			packet_len;
+	uint8_t			vector[AUTH_VECTOR_LEN];	//!< The Request Authenticator which was sent.
+	rlm_radius_key_t	key;			//!< Of the request from the NAS.
+
+	uint8_t			*reply;			//!< From the home server, or NULL for no reply.
+	size_t			reply_len;
+	bool			follower;		//!< A retransmission of a request which was
+							//!< already being proxied.
+} rlm_radius_shared_msg_t;
+
+/** A worker which uses the shared I/O thread
+ *
+ */
+struct rlm_radius_worker_t {
+	fr_dlist_t		entry;			//!< In the list of workers.
+	fr_atomic_queue_t	*aq;			//!< Replies for the worker.
+	int			kq;			//!< The worker's kqueue.
+	uintptr_t		ident;			//!< Wakes the worker up.
+	bool			alive;			//!< Protected by the shared mutex.
+	bool			wake;			//!< There are new replies.  Only the I/O thread uses this.
+
+	uint32_t		outstanding;		//!< Requests with the I/O thread.  Only the worker uses this.
+	bool			submitted;		//!< We've pushed requests.  Only the worker uses this.
+
+	rlm_radius_shared_t	*shared;		//!< The I/O thread we use.
+};
+
+/** The I/O thread which owns the connections, when they're shared
+ *
+ */
+struct rlm_radius_shared_t {
+	pthread_mutex_t		mutex;			//!< Protects the fields below.
+	uint32_t		num_workers;		//!< Workers using the I/O thread.
+	fr_dlist_t		workers;		//!< All of the worker slots.
+	pthread_t		pthread_id;
+	bool			running;
+
+	fr_event_list_t		*el;			//!< The I/O thread's event list.
+	int			kq;			//!< The I/O thread's kqueue.
+	uintptr_t		ident;			//!< Wakes the I/O thread up.
+	fr_atomic_queue_t	*aq;			//!< Requests from the workers.
+	atomic_bool		exiting;		//!< Tells the I/O thread to stop.
+
+	rlm_radius_thread_t	*thread;		//!< Home servers and connections, as for a worker.
+	fr_dlist_t		returning;		//!< Replies to push back to the workers.
+};
+
+/** A packet waiting to be replicated
+ *
+ * These are malloc'd, as they're freed by a different thread from
+ * the one which allocated them.
+ */
+typedef struct {
+	size_t			data_len;
+	uint8_t			data[];			//!< Encoded, but not signed.
+} rlm_radius_replica_packet_t;
+
+/** One collector we replicate packets to
+ *
+ */
+typedef struct {
+	rlm_radius_home_server_t const *home_server;	//!< The home server this is for.
+	fr_atomic_queue_t	*aq;			//!< Packets from the workers.
+
+	atomic_uint_fast64_t	queued;			//!< Packets the workers queued.
+	atomic_uint_fast64_t	dropped;		//!< Packets thrown away because the queue was full.
+
+	/*
+	 *	Only the replication thread uses these.
+	 */
+	int			fd;			//!< Socket, or -1 if it isn't open.
+	void			*client_io_ctx;		//!< client IO context.
+	fr_time_t		next_open;		//!< When we can try to open the socket again.
+	rlm_radius_replica_packet_t *pending;		//!< Packet the socket wasn't ready for.
+	uint8_t			id;			//!< Next RADIUS ID.
+	uint64_t		tokens;			//!< Packets we can send, in nanoseconds of max_rate.
+	uint64_t		sent;			//!< Packets written to the socket.
+	uint64_t		failed;			//!< Packets we couldn't write.
+	uint64_t		reported;		//!< Drops we've already complained about.
+} rlm_radius_replica_t;
+
+/** The thread which sends packets to the collectors
+ *
+ */
+struct rlm_radius_replicate_t {
+	pthread_mutex_t		mutex;			//!< Protects num_workers, and starting and stopping.
+	uint32_t		num_workers;		//!< Workers which may queue packets.
+	pthread_t		pthread_id;
+	bool			running;
+
+	fr_event_list_t		*el;			//!< The replication thread's event list.
+	fr_event_timer_t const	*ev;			//!< Sends packets every RLM_RADIUS_REPLICATE_INTERVAL.
+	fr_time_t		last;			//!< When the timer last ran.
+	fr_time_t		last_report;		//!< When we last checked for drops.
+	atomic_bool		exiting;		//!< Tells the replication thread to stop.
+
+	rlm_radius_t const	*inst;			//!< Instance of the module.
+	rlm_radius_replica_t	*replica;		//!< One per home server.
+};
+
+/** A spooled packet which is being replayed
+ *
+ */
+typedef struct {
+	radius_spool_pos_t	next;			//!< Just after the packet, in the spool.
+	fr_time_t		sent;			//!< When it was last written, or 0.
+	bool			acked;			//!< The home server replied.
+	size_t			data_len;
+	uint8_t			data[MAX_PACKET_LEN];	//!< Signed, with its ID.
+} rlm_radius_replay_slot_t;
+
+/** The thread which replays spooled packets
+ *
+ * Packets are replayed to one home server at a time, in the order
+ * they were spooled.  They're only removed from the spool once the
+ * home server has replied, so a packet may be sent more than once.
+ */
+struct rlm_radius_replay_t {
+	pthread_mutex_t		mutex;			//!< Protects num_workers, and starting and stopping.
+	uint32_t		num_workers;		//!< Workers which may spool packets.
+	pthread_t		pthread_id;
+	bool			running;
+
+	fr_event_list_t		*el;			//!< The replay thread's event list.
+	fr_event_timer_t const	*ev;			//!< Replays packets every RLM_RADIUS_REPLICATE_INTERVAL.
+	fr_time_t		last;			//!< When the timer last ran.
+	atomic_bool		exiting;		//!< Tells the replay thread to stop.
+	atomic_uint_fast64_t	replayed;		//!< Packets the home servers replied to.
+
+	rlm_radius_t const	*inst;			//!< Instance of the module.
+
+	/*
+	 *	Only the replay thread uses these.
+	 */
+	uint32_t		home;			//!< The home server we're replaying to.
+	int			fd;			//!< Socket, or -1 if it isn't open.
+	void			*client_io_ctx;		//!< client IO context.
+	fr_time_t		next_open;		//!< When we can try to open the socket again.
+	uint32_t		unanswered;		//!< Packets which timed out since the last reply.
+	uint64_t		tokens;			//!< Packets we can send, in nanoseconds of max_rate.
+
+	radius_spool_pos_t	read;			//!< The next packet to read from the spool.
+	rlm_radius_replay_slot_t *slot;			//!< One per ID, "window" of them.
+	uint32_t		head;			//!< The oldest packet we're replaying.
+	uint32_t		num;			//!< How many we're replaying.
+};
 
 struct rlm_radius_connection_t {
 	char const		*name;			//!< humanly readable name of this connection
@@ -74,24 +445,63 @@ struct rlm_radius_connection_t {
 	fr_dlist_t		entry;			//!< in connected / opening list
 	rlm_radius_t const	*inst;			//!< Instance of the module.
 	rlm_radius_thread_t	*thread;		//!< thread instance
+	rlm_radius_home_t	*home;			//!< The home server we're connected to.
 	fr_event_list_t		*el;			//!< This thread's event list.
 
 	fr_connection_t		*conn;			//!< Connection to our destination.
 
 	void			*client_io_ctx;		//!< client IO context
 
+	bool			active;			//!< in the "active" list.
 	bool			pending;		//!< we have pending messages to write
 	int			waiting;		//!< written, but waiting for replies
 
 	fr_dlist_t		queued;			//!< queued for sending
 	fr_dlist_t		sent;			//!< actually sent
+
+	uint64_t		id_free[RLM_RADIUS_MAX_IDS / 64];	//!< One bit per ID, set if it's free.
+	int			num_free;		//!< Number of free IDs.
+	struct rlm_radius_link_t *id[RLM_RADIUS_MAX_IDS];	//!< Which request is using each ID.
+
+	fr_event_timer_t const	*idle_ev;		//!< Closes the connection when it's unused.
+
+	fr_time_t		rtt;			//!< Moving average of the response time.
+
+	bool			zombie;			//!< Not replying, and in the "frozen" list.
+	fr_time_t		last_reply;		//!< When we last received a reply.
+	uint32_t		unanswered;		//!< Requests which timed out since the last reply.
+
+	RADIUS_PACKET		*status_packet;		//!< The Status-Server probe we're waiting on.
+	fr_time_t		status_sent;		//!< When the probe was sent.
+	uint8_t			status_id;		//!< ID for the next probe.
+	bool			status_replied;		//!< The home server answered the current probe.
+	uint32_t		num_answers;		//!< Consecutive probes which were answered.
+	struct timeval		status_interval;	//!< How long until the next probe.
+	fr_event_timer_t const	*status_ev;		//!< Sends the next probe.
 };
 
 typedef struct rlm_radius_link_t {
 	bool			waiting;       		//!< queued or live
 	REQUEST			*request;		//!< the request we are for
 	fr_dlist_t		entry;			//!< linked list of queued or sent
+	rlm_radius_home_t	*home;			//!< which home server we're proxying to
 	rlm_radius_connection_t	*c;			//!< which connection we're queued or sent
+	int			id;			//!< RADIUS ID, or -1 if we don't have one.
+	fr_time_t		start;			//!< When we started proxying the request.
+	fr_time_t		sent;			//!< When the packet was written.
+	RADIUS_PACKET		*packet;		//!< The packet we sent, once it's been encoded.
+	rlm_rcode_t		rcode;			//!< Result of proxying the request.
+	struct rlm_radius_link_t *hedge;		//!< Copy of the request for another home server.
+	struct rlm_radius_link_t *primary;		//!< For a hedge, the link the request yielded on.
+	rlm_radius_shared_msg_t	*msg;			//!< In a worker, what we gave the I/O thread.
+							//!< In the I/O thread, what we're proxying.
+	fr_event_timer_t const	*ev;			//!< Response timeout, in the I/O thread.
+
+	rlm_radius_key_t	key;			//!< Of the request from the NAS.
+	fr_hash_table_t		*inflight;		//!< The table we're in, if any.
+	fr_dlist_t		followers;		//!< Retransmissions waiting for our reply.  Links,
+							//!< or in the I/O thread, messages from the workers.
+	bool			spool;			//!< Spool the request if it fails.
 	void			*request_io_ctx;
 } rlm_radius_link_t;
 
@@ -106,6 +516,72 @@ static CONF_PARSER const timer_config[] = {
 	{ FR_CONF_OFFSET("idle", FR_TYPE_TIMEVAL, rlm_radius_t, idle_timeout),
 	  .dflt = STRINGIFY(300) },
 
+	{ FR_CONF_OFFSET("response", FR_TYPE_TIMEVAL, rlm_radius_t, response_timeout),
+	  .dflt = STRINGIFY(30) },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static CONF_PARSER const zombie_config[] = {
+	{ FR_CONF_OFFSET("period", FR_TYPE_TIMEVAL, rlm_radius_t, zombie_period),
+	  .dflt = STRINGIFY(10) },
+
+	{ FR_CONF_OFFSET("unanswered", FR_TYPE_UINT32, rlm_radius_t, max_unanswered), .dflt = "5" },
+
+	{ FR_CONF_OFFSET("check_interval", FR_TYPE_TIMEVAL, rlm_radius_t, check_interval),
+	  .dflt = STRINGIFY(1) },
+
+	{ FR_CONF_OFFSET("max_check_interval", FR_TYPE_TIMEVAL, rlm_radius_t, max_check_interval),
+	  .dflt = STRINGIFY(30) },
+
+	{ FR_CONF_OFFSET("num_answers_to_alive", FR_TYPE_UINT32, rlm_radius_t, num_answers_to_alive), .dflt = "3" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static CONF_PARSER const hedge_config[] = {
+	{ FR_CONF_OFFSET("mode", FR_TYPE_STRING, rlm_radius_t, hedge_mode_str), .dflt = "none" },
+
+	{ FR_CONF_OFFSET("percentile", FR_TYPE_UINT32, rlm_radius_t, hedge_percentile), .dflt = "95" },
+
+	{ FR_CONF_OFFSET("max_load", FR_TYPE_UINT32, rlm_radius_t, hedge_max_load), .dflt = "10" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static CONF_PARSER const replicate_config[] = {
+	{ FR_CONF_OFFSET("queue_size", FR_TYPE_UINT32, rlm_radius_t, replicate_queue_size), .dflt = "4096" },
+
+	{ FR_CONF_OFFSET("max_rate", FR_TYPE_UINT32, rlm_radius_t, replicate_max_rate), .dflt = "0" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static CONF_PARSER const spool_config[] = {
+	{ FR_CONF_OFFSET("directory", FR_TYPE_STRING, rlm_radius_t, spool_directory) },
+
+	{ FR_CONF_OFFSET("segment_size", FR_TYPE_SIZE, rlm_radius_t, spool_segment_size), .dflt = "16777216" },
+
+	{ FR_CONF_OFFSET("max_size", FR_TYPE_SIZE, rlm_radius_t, spool_max_size), .dflt = "1073741824" },
+
+	{ FR_CONF_OFFSET("sync", FR_TYPE_BOOL, rlm_radius_t, spool_sync), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("max_rate", FR_TYPE_UINT32, rlm_radius_t, spool_max_rate), .dflt = "0" },
+
+	{ FR_CONF_OFFSET("window", FR_TYPE_UINT32, rlm_radius_t, spool_window), .dflt = "32" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static CONF_PARSER const connection_config[] = {
+	{ FR_CONF_OFFSET("min", FR_TYPE_UINT32, rlm_radius_t, min_connections), .dflt = "1" },
+
+	{ FR_CONF_OFFSET("max", FR_TYPE_UINT32, rlm_radius_t, max_connections), .dflt = "32" },
+
+	{ FR_CONF_OFFSET("spare_ids", FR_TYPE_UINT32, rlm_radius_t, spare_ids), .dflt = "64" },
+
+	{ FR_CONF_OFFSET("shared", FR_TYPE_BOOL, rlm_radius_t, shared_connections), .dflt = "no" },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -118,15 +594,32 @@ static CONF_PARSER const module_config[] = {
 	{ FR_CONF_OFFSET("transport", FR_TYPE_VOID, rlm_radius_t, io_submodule),
 	  .func = transport_parse },
 
+	{ FR_CONF_OFFSET("secret", FR_TYPE_STRING | FR_TYPE_SECRET | FR_TYPE_REQUIRED, rlm_radius_t, secret) },
+
+	{ FR_CONF_OFFSET("mode", FR_TYPE_STRING, rlm_radius_t, mode_str), .dflt = "proxy" },
+
 	{ FR_CONF_POINTER("timers", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) timer_config },
 
+	{ FR_CONF_POINTER("connections", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) connection_config },
+
+	{ FR_CONF_POINTER("zombie", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) zombie_config },
+
+	{ FR_CONF_POINTER("hedge", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) hedge_config },
+
+	{ FR_CONF_POINTER("replicate", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) replicate_config },
+
+	{ FR_CONF_POINTER("spool", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) spool_config },
+
 	CONF_PARSER_TERMINATOR
 };
 
 /** Wrapper around dl_instance
+ *
+ * Every transport section is a home server, e.g. "udp local { ... }"
+ * and "udp remote { ... }".
  *
  * @param[in] ctx	to allocate data in (instance of proto_radius).
- * @param[out] out	Where to write a dl_instance_t containing the module handle and instance.
+ * @param[out] out	Where to write an array of dl_instance_t containing the module handle and instance.
  * @param[in] ci	#CONF_PAIR specifying the name of the type module.
  * @param[in] rule	unused.
  * @return
@@ -137,10 +630,12 @@ static int transport_parse(TALLOC_CTX *ctx, void *out, CONF_ITEM *ci, UNUSED CON
 {
 	char const	*name = cf_pair_value(cf_item_to_pair(ci));
 	dl_instance_t	*parent_inst;
+	dl_instance_t	**submodules = NULL;
 	CONF_SECTION	*cs = cf_item_to_section(cf_parent(ci));
 	CONF_SECTION	*transport_cs;
+	size_t		i = 0;
 
-	transport_cs = cf_section_find(cs, name, NULL);
+	transport_cs = cf_section_find(cs, name, CF_IDENT_ANY);
 
 	/*
 	 *	Allocate an empty section if one doesn't exist
@@ -151,7 +646,21 @@ static int transport_parse(TALLOC_CTX *ctx, void *out, CONF_ITEM *ci, UNUSED CON
 	parent_inst = cf_data_value(cf_data_find(cs, dl_instance_t, "rlm_radius"));
 	rad_assert(parent_inst);
 
-	return dl_instance(ctx, out, transport_cs, parent_inst, name, DL_TYPE_SUBMODULE);
+	while (transport_cs) {
+		MEM(submodules = talloc_realloc(ctx, submodules, dl_instance_t *, i + 1));
+
+		if (dl_instance(ctx, &submodules[i], transport_cs, parent_inst, name, DL_TYPE_SUBMODULE) < 0) {
+			talloc_free(submodules);
+			return -1;
+		}
+		i++;
+
+		transport_cs = cf_section_find_next(cs, transport_cs, name, CF_IDENT_ANY);
+	}
+
+	*(dl_instance_t ***) out = submodules;
+
+	return 0;
 }
 
 
@@ -161,584 +670,3813 @@ static void mod_radius_fd_active(rlm_radius_connection_t *c);
 
 static void mod_radius_conn_error(UNUSED fr_event_list_t *el, int sock, UNUSED int flags, int fd_errno, void *uctx);
 
-static int CC_HINT(nonnull) mod_add(rlm_radius_t *inst, rlm_radius_connection_t *c, REQUEST *request);
+static int mod_radius_conn_alloc(rlm_radius_home_t *home);
+
+static void CC_HINT(nonnull) mod_add(rlm_radius_connection_t *c, rlm_radius_link_t *link);
 
-/** Clear the backlog of t->queued
+static void mod_status_start(rlm_radius_connection_t *c);
+
+static void mod_shared_done(rlm_radius_link_t *link);
+
+/** Allocate the lowest free ID on a connection
  *
+ * The bitmap is four words, so this is O(1) no matter how many
+ * IDs are in use.
+ *
+ * @param[in] c		to allocate the ID on.  Must have free IDs.
+ * @return the ID.
  */
-static void mod_clear_backlog(UNUSED rlm_radius_thread_t *t)
+static int mod_id_alloc(rlm_radius_connection_t *c)
 {
-	//@ todo - move t->queued to new connections
-	// call mod_add() with the request
+	int i, bit;
+
+	for (i = 0; i < (RLM_RADIUS_MAX_IDS / 64); i++) {
+		if (!c->id_free[i]) continue;
+
+		bit = __builtin_ctzll(c->id_free[i]);
+		c->id_free[i] &= ~(((uint64_t) 1) << bit);
+		c->num_free--;
+		if (c->active) c->home->num_free--;
+
+		/*
+		 *	The connection is in use, so it isn't idle.
+		 */
+		if (c->idle_ev) (void) fr_event_timer_delete(c->el, &c->idle_ev);
+
+		return (i * 64) + bit;
+	}
+
+	rad_assert(0 == 1);
+	return -1;
 }
 
-/** Drain any data we received
+/** Close a connection which hasn't been used for "idle" seconds
  *
- * We don't care about this data, we just don't want the kernel to
- * signal the other side that our read buffer's full.
  */
-static void mod_radius_conn_read(UNUSED fr_event_list_t *el, UNUSED int sock, UNUSED int flags, UNUSED void *uctx)
+static void mod_radius_conn_idle(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
 {
-//	rlm_radius_connection_t		*c = talloc_get_type_abort(uctx, rlm_radius_connection_t);
+	rlm_radius_connection_t	*c = talloc_get_type_abort(uctx, rlm_radius_connection_t);
 
-	// read a reply from the sub-module
-	// find the original request
-	// check signature
-	// if OK, resume it
+	DEBUG2("Closing idle connection - %s", c->name);
+	talloc_free(c);
 }
 
-/** There's space available to write data, so do that...
+/** Release an ID, so that it can be used for another request
  *
+ * When the last ID on a connection is released, and the thread can
+ * do without the connection, we close it after "idle" seconds.
  */
-static void mod_radius_conn_writable(UNUSED fr_event_list_t *el, UNUSED int sock, UNUSED int flags, void *uctx)
+static void mod_id_free(rlm_radius_connection_t *c, int id)
 {
-	rlm_radius_connection_t	*c = talloc_get_type_abort(uctx, rlm_radius_connection_t);
+	rlm_radius_home_t	*home = c->home;
+	rlm_radius_t const	*inst = c->inst;
+	struct timeval		when;
 
-	// dequeue a REQUEST
-	// encode it
-	// write it to the socket
-	// if EWOULDBLOCK, return.
+	rad_assert(c->id[id] != NULL);
 
-	mod_radius_fd_idle(c);
+	c->id[id] = NULL;
+	c->id_free[id / 64] |= ((uint64_t) 1) << (id % 64);
+	c->num_free++;
+	if (c->active) home->num_free++;
+
+	if (c->num_free < RLM_RADIUS_MAX_IDS) return;
+
+	if (!c->active || (home->num_connections <= inst->min_connections)) return;
+
+	if ((home->num_free - RLM_RADIUS_MAX_IDS) < inst->spare_ids) return;
+
+	gettimeofday(&when, NULL);
+	fr_timeval_add(&when, &when, &inst->idle_timeout);
+
+	if (fr_event_timer_insert(c, c->el, &c->idle_ev, &when, mod_radius_conn_idle, c) < 0) {
+		PERROR("Failed inserting idle timer");
+	}
 }
 
-/** Set the socket to idle
+/** Hash the key of a request from the NAS
  *
- *  But keep the read event open, just in case the other end sends us
- *  data  That way we can process it.
- *
- * @param[in] c		Connection data structure
  */
-static void mod_radius_fd_idle(rlm_radius_connection_t *c)
+static uint32_t mod_key_hash(void const *data)
 {
-	DEBUG3("Marking socket (%i) as idle", fr_connection_get_fd(c->conn));
-	if (fr_event_fd_insert(c, c->el, fr_connection_get_fd(c->conn),
-			       mod_radius_conn_read, NULL, mod_radius_conn_error, c) < 0) {
-		PERROR("Failed inserting FD event");
+	rlm_radius_key_t const	*key = data;
+	uint32_t		hash;
+
+	hash = fr_hash(key->vector, sizeof(key->vector));
+	hash = fr_hash_update(&key->id, sizeof(key->id), hash);
+	hash = fr_hash_update(&key->code, sizeof(key->code), hash);
+	hash = fr_hash_update(&key->src_port, sizeof(key->src_port), hash);
+
+	if (key->src_ipaddr.af == AF_INET) {
+		return fr_hash_update(&key->src_ipaddr.addr.v4, sizeof(key->src_ipaddr.addr.v4), hash);
 	}
+
+	return fr_hash_update(&key->src_ipaddr.addr.v6, sizeof(key->src_ipaddr.addr.v6), hash);
 }
 
-/** Set the socket to active
+/** Compare the keys of two requests from the NAS
  *
- * We have messages we want to send, so need to know when the socket is writable.
+ */
+static int mod_key_cmp(void const *one, void const *two)
+{
+	rlm_radius_key_t const	*a = one;
+	rlm_radius_key_t const	*b = two;
+	int			rcode;
+
+	rcode = memcmp(a->vector, b->vector, sizeof(a->vector));
+	if (rcode != 0) return rcode;
+
+	rcode = a->id - b->id;
+	if (rcode != 0) return rcode;
+
+	rcode = a->code - b->code;
+	if (rcode != 0) return rcode;
+
+	rcode = a->src_port - b->src_port;
+	if (rcode != 0) return rcode;
+
+	return fr_ipaddr_cmp(&a->src_ipaddr, &b->src_ipaddr);
+}
+
+/** Get the key of a request from the NAS
  *
- * @param[in] c		Connection data structure
  */
-static void mod_radius_fd_active(rlm_radius_connection_t *c)
+static void mod_key_init(rlm_radius_key_t *key, REQUEST *request)
 {
-	DEBUG3("Marking socket (%i) as active - Draining requests", fr_connection_get_fd(c->conn));
-	if (fr_event_fd_insert(c, c->el, fr_connection_get_fd(c->conn),
-			       mod_radius_conn_read, mod_radius_conn_writable, mod_radius_conn_error, c) < 0) {
-		PERROR("Failed inserting FD event");
-	}
+	memset(key, 0, sizeof(*key));
+
+	key->src_ipaddr = request->packet->src_ipaddr;
+	key->src_port = request->packet->src_port;
+	key->code = request->packet->code;
+	key->id = request->packet->id;
+	memcpy(key->vector, request->packet->vector, sizeof(key->vector));
 }
 
-/** Connection errored
+/** Find the request we're already proxying, for a retransmission
  *
  */
-static void mod_radius_conn_error(UNUSED fr_event_list_t *el, int sock, UNUSED int flags, int fd_errno, void *uctx)
+static rlm_radius_link_t *mod_inflight_find(rlm_radius_thread_t *t, rlm_radius_key_t const *key)
 {
-	rlm_radius_connection_t	*c = talloc_get_type_abort(uctx, rlm_radius_connection_t);
+	rlm_radius_key_t *found;
 
-	ERROR("Connection failed (%i): %s", sock, fr_syserror(fd_errno));
+	found = fr_hash_table_finddata(t->inflight, key);
+	if (!found) return NULL;
 
-	/*
-	 *	Something bad happened... Fix it.  The connection API
-	 *	will take care of deleting the FD from the event list,
-	 *	and will call our mod_radius_conn_close() routine.
-	 */
-	fr_connection_reconnect(c->conn);
+	return fr_ptr_to_type(rlm_radius_link_t, key, found);
 }
 
-/** Deal with a failure case.
+/** Let retransmissions of a request find it
  *
  */
-static fr_connection_state_t mod_radius_conn_failed(UNUSED int fd, fr_connection_state_t prev, void *uctx)
+static void mod_inflight_insert(rlm_radius_thread_t *t, rlm_radius_link_t *link)
 {
-	rlm_radius_connection_t	*c = talloc_get_type_abort(uctx, rlm_radius_connection_t);
-	rlm_radius_thread_t	*t = c->thread;
-	fr_dlist_t		*entry, *next;
-
-	/*
-	 *	If it's not trying to reconnect, trash the entire
-	 *	connection.
-	 */
-	if (prev != FR_CONNECTION_STATE_CONNECTED) {
-		talloc_free(c);
-		return FR_CONNECTION_STATE_HALTED;
-	}
+	if (!fr_hash_table_insert(t->inflight, &link->key)) return;
 
-	/*
-	 *	Remove the connection from whatever list it's in, and
-	 *	add it to the "closed" list.
-	 */
-	fr_dlist_remove(&c->entry);
-	fr_dlist_insert_tail(&t->closed, &c->entry);
+	link->inflight = t->inflight;
+}
 
-	/*
-	 *	Move any requests from the "sent" back to the
-	 *	"queued" list.
-	 */
-	for (entry = FR_DLIST_FIRST(c->sent);
-	     entry != NULL;
-	     entry = next) {
-		rlm_radius_link_t *link;
+/** Retransmissions can't use the request any more
+ *
+ * Safe to call more than once.
+ */
+static void mod_inflight_remove(rlm_radius_link_t *link)
+{
+	if (!link->inflight) return;
+
+	(void) fr_hash_table_yank(link->inflight, &link->key);
+	link->inflight = NULL;
+}
+
+/** Give the reply to a request to its retransmissions, too
+ *
+ */
+static void mod_followers_reply(rlm_radius_link_t *leader, RADIUS_PACKET *reply)
+{
+	fr_dlist_t	*entry;
+	VALUE_PAIR	*vps;
+
+	while ((entry = FR_DLIST_FIRST(leader->followers)) != NULL) {
+		rlm_radius_link_t	*link;
+		REQUEST			*request;
 
 		link = fr_ptr_to_type(rlm_radius_link_t, entry, entry);
+		request = link->request;
 
-		next = FR_DLIST_NEXT(c->sent, entry);
+		fr_dlist_remove(&link->entry);
+		(void) unlang_event_timeout_delete(request, link);
+
+		RDEBUG("Received %s for the original request", fr_packet_codes[reply->code]);
+
+		vps = fr_pair_list_copy(request->reply, reply->vps);
+		if (vps) fr_pair_add(&request->reply->vps, vps);
+
+		link->rcode = leader->rcode;
+		request->reply->code = reply->code;
+
+		unlang_resumable(request);
+	}
+}
+
+/** The request failed, so its retransmissions fail, too
+ *
+ */
+static void mod_followers_fail(rlm_radius_link_t *leader)
+{
+	fr_dlist_t *entry;
+
+	while ((entry = FR_DLIST_FIRST(leader->followers)) != NULL) {
+		rlm_radius_link_t	*link;
+		REQUEST			*request;
 
-		rad_assert(link->waiting = true);
+		link = fr_ptr_to_type(rlm_radius_link_t, entry, entry);
+		request = link->request;
+
+		fr_dlist_remove(&link->entry);
+		(void) unlang_event_timeout_delete(request, link);
+
+		REDEBUG("The original request failed");
+
+		link->rcode = RLM_MODULE_FAIL;
+		unlang_resumable(request);
+	}
+}
+
+/** Remove a request from its connection, and release its ID
+ *
+ * Safe to call more than once.
+ */
+static void mod_link_unlink(rlm_radius_link_t *link)
+{
+	rlm_radius_connection_t *c = link->c;
+
+	fr_dlist_remove(&link->entry);
+
+	if (!c) return;
+
+	if (link->waiting) {
 		link->waiting = false;
 		c->waiting--;
+	}
+
+	if (link->id >= 0) {
+		mod_id_free(c, link->id);
+		link->id = -1;
+	}
+
+	link->c = NULL;
+}
+
+/** Remove a request from its connection, so that it can go to another one
+ *
+ * The packet has to be encoded again, with its new ID.
+ */
+static void mod_link_requeue(rlm_radius_link_t *link)
+{
+	mod_link_unlink(link);
+	TALLOC_FREE(link->packet);
+}
+
+/** Remove a request from its home server, and its connection
+ *
+ * Safe to call more than once.
+ */
+static void mod_link_release(rlm_radius_link_t *link)
+{
+	mod_link_unlink(link);
+
+	if (link->home) {
+		link->home->outstanding--;
+		link->home = NULL;
+	}
+}
+
+/** Stop proxying a request, to every home server it was sent to
+ *
+ * The links aren't freed until the request resumes.
+ *
+ * @param[in] link	either copy of the request.
+ * @return the link the request yielded on.
+ */
+static rlm_radius_link_t *mod_link_finish(rlm_radius_link_t *link)
+{
+	rlm_radius_link_t	*primary = link->primary ? link->primary : link;
+	REQUEST			*request = primary->request;
+
+	mod_link_release(primary);
+	mod_inflight_remove(primary);
+	(void) unlang_event_timeout_delete(request, primary);
+
+	/*
+	 *	The I/O thread still has the request, and will give it
+	 *	back to us.
+	 */
+	if (primary->msg) {
+		atomic_store(&primary->msg->cancelled, true);
+		primary->msg = NULL;
+	}
+
+	if (primary->hedge) {
+		mod_link_release(primary->hedge);
+		(void) unlang_event_timeout_delete(request, primary->hedge);
+	}
+
+	return primary;
+}
+
+/** Fail one copy of a request
+ *
+ * If it's a hedged copy, the first home server may still reply.
+ */
+static void mod_link_fail(rlm_radius_link_t *link)
+{
+	rlm_radius_link_t	*primary;
+
+	if (!link->request) {
+		mod_shared_done(link);
+		return;
+	}
+
+	if (link->primary) {
+		mod_link_release(link);
+		return;
+	}
+
+	primary = mod_link_finish(link);
+	primary->rcode = RLM_MODULE_FAIL;
+	unlang_resumable(primary->request);
+}
+
+/** Whether all of our connections to a home server are zombie
+ *
+ */
+static inline bool mod_home_dead(rlm_radius_home_t const *home)
+{
+	return (home->num_zombie > 0) && (home->num_zombie == home->num_connections);
+}
+
+/** Find a connection with a free ID
+ *
+ * Connections are used in the order they were opened.  Under light
+ * load the later connections drain, and are closed when they're idle.
+ */
+static rlm_radius_connection_t *mod_connection_find(rlm_radius_home_t *home)
+{
+	fr_dlist_t *entry;
+
+	for (entry = FR_DLIST_FIRST(home->active);
+	     entry != NULL;
+	     entry = FR_DLIST_NEXT(home->active, entry)) {
+		rlm_radius_connection_t *c;
+
+		c = fr_ptr_to_type(rlm_radius_connection_t, entry, entry);
+		if (c->num_free > 0) return c;
+	}
+
+	return NULL;
+}
+
+/** Open another connection if we're running out of IDs
+ *
+ * Only one connection is opened at a time.  When it's connected, it
+ * takes the backlog, and we check again.
+ */
+static void mod_connection_check(rlm_radius_home_t *home)
+{
+	rlm_radius_t const	*inst = home->thread->inst;
+	fr_dlist_t		*entry;
+
+	if (home->num_connections >= inst->max_connections) return;
+
+	/*
+	 *	The home server isn't replying on any connection.
+	 *	Opening more won't help, so wait for the Status-Server
+	 *	probes to revive one.
+	 */
+	if (mod_home_dead(home)) return;
+
+	entry = FR_DLIST_FIRST(home->closed);
+	if (entry) return;
+
+	entry = FR_DLIST_FIRST(home->queued);
+	if (!entry && (home->num_free >= inst->spare_ids)) return;
+
+	DEBUG2("%u IDs are free, opening another connection to %s", home->num_free, home->home_server->name);
+	(void) mod_radius_conn_alloc(home);
+}
+
+/** Clear the backlog of home->queued
+ *
+ *  Requests are only queued here when their connection goes away,
+ *  or there are no IDs free on any connection.
+ */
+static void mod_clear_backlog(rlm_radius_home_t *home)
+{
+	fr_dlist_t *entry;
+
+	while ((entry = FR_DLIST_FIRST(home->queued)) != NULL) {
+		rlm_radius_connection_t *c;
+		rlm_radius_link_t *link;
 
+		c = mod_connection_find(home);
+		if (!c) return;
+
+		link = fr_ptr_to_type(rlm_radius_link_t, entry, entry);
 		fr_dlist_remove(&link->entry);
 
-		// @todo - insert into the list by when we first sent
-		// the packet, so that earlier packets are handled
-		// before later packets
-		fr_dlist_insert_tail(&c->queued, &link->entry);
+		mod_add(c, link);
+	}
 
-		c->pending = true;
+	home->pending = false;
+}
+
+/** Add a response time to a moving average
+ *
+ */
+static inline void mod_rtt_update(fr_time_t *rtt, fr_time_t sample)
+{
+	if (!*rtt) {
+		*rtt = sample;
+		return;
 	}
 
+	*rtt = *rtt - (*rtt >> RLM_RADIUS_RTT_SHIFT) + (sample >> RLM_RADIUS_RTT_SHIFT);
+}
+
+/** Pick a home server
+ *
+ * Compare two home servers chosen at random, and use the one where
+ * we expect the reply soonest.  That's the moving average of its
+ * response time, for each request which is already waiting on it.
+ *
+ * Home servers we haven't heard from yet have no response time, and
+ * are tried first.  Slow home servers get fewer requests, long
+ * before they start timing out.
+ */
+static rlm_radius_home_t *mod_home_select(rlm_radius_thread_t *t)
+{
+	rlm_radius_t const	*inst = t->inst;
+	rlm_radius_home_t	*a, *b;
+	uint32_t		i, j;
+
+	if (inst->num_home_servers == 1) return &t->home[0];
+
+	i = fr_rand() % inst->num_home_servers;
+	j = fr_rand() % (inst->num_home_servers - 1);
+	if (j >= i) j++;
+
+	a = &t->home[i];
+	b = &t->home[j];
+
 	/*
-	 *	Once the connection is open again, the pending queue
-	 *	will be automatically cleared by the "open" callback.
+	 *	Fail over to a home server which has connections that
+	 *	are still replying.
 	 */
+	if (mod_home_dead(a) != mod_home_dead(b)) return mod_home_dead(a) ? b : a;
 
-	return FR_CONNECTION_STATE_INIT;
+	if ((a->rtt * (a->outstanding + 1)) <= (b->rtt * (b->outstanding + 1))) return a;
+
+	return b;
 }
 
-/** Process notification that fd is open
+/** Pick a second home server for a hedged request
+ *
+ * This is the one where we expect the reply soonest, other than the
+ * home server the request was first sent to.
  *
+ * @return
+ *	- the home server.
+ *	- NULL if there's no other home server which is replying.
  */
-static fr_connection_state_t mod_radius_conn_open(UNUSED int fd, UNUSED fr_event_list_t *el, void *uctx)
+static rlm_radius_home_t *mod_home_select_hedge(rlm_radius_thread_t *t, rlm_radius_home_t *exclude)
 {
-	rlm_radius_connection_t	*c = talloc_get_type_abort(uctx, rlm_radius_connection_t);
-	rlm_radius_thread_t	*t = c->thread;
-	rlm_radius_t const	*inst = talloc_get_type_abort(t->inst, rlm_radius_t);
+	rlm_radius_t const	*inst = t->inst;
+	rlm_radius_home_t	*best = NULL;
+	uint32_t		i;
 
-	c->name = inst->client_io->get_name(c, c->client_io_ctx);
+	for (i = 0; i < inst->num_home_servers; i++) {
+		rlm_radius_home_t *home = &t->home[i];
 
-	DEBUG2("Connected - %s", c->name);
+		if ((home == exclude) || mod_home_dead(home)) continue;
+
+		if (!best || ((home->rtt * (home->outstanding + 1)) < (best->rtt * (best->outstanding + 1)))) {
+			best = home;
+		}
+	}
+
+	return best;
+}
+
+/** Add a response time to the histogram used for the hedge delay
+ *
+ * The hedge delay is only recalculated every few replies, and the
+ * histogram is cleared from time to time so that it follows changes
+ * in the home server's response time.
+ */
+static void mod_hedge_sample(rlm_radius_home_t *home, fr_time_t rtt)
+{
+	rlm_radius_t const	*inst = home->thread->inst;
+	uint64_t		count;
+
+	fr_time_histogram_add(&home->histogram, rtt);
+
+	count = atomic_load_explicit(&home->histogram.count, memory_order_relaxed);
+	if ((count % RLM_RADIUS_HEDGE_UPDATE) != 0) return;
+
+	home->hedge_delay = fr_time_histogram_percentile(&home->histogram, inst->hedge_percentile);
+
+	if (count >= RLM_RADIUS_HEDGE_WINDOW) memset(&home->histogram, 0, sizeof(home->histogram));
+}
+
+/** Whether we can afford to send another hedged request
+ *
+ * Each request earns "max_load" hundredths of a hedged request, and
+ * each hedged request spends one.
+ */
+static bool mod_hedge_budget(rlm_radius_thread_t *t)
+{
+	if (t->hedge_budget < 100) return false;
+
+	t->hedge_budget -= 100;
+	return true;
+}
+
+/** Encode a request, using the ID it was given
+ *
+ */
+static int mod_encode(rlm_radius_t const *inst, rlm_radius_link_t *link)
+{
+	REQUEST		*request = link->request;
+	RADIUS_PACKET	*packet;
+	ssize_t		packet_len;
+	uint8_t		buffer[MAX_PACKET_LEN];
+
+	packet = fr_radius_alloc(link, true);
+	if (!packet) return -1;
 
 	/*
-	 *	Remove the connection from the "frozen" list, and add
-	 *	it to the "active" list.
+	 *	The worker has already encoded the packet.  We only
+	 *	have to give it an ID, and sign it again.
 	 */
-	fr_dlist_remove(&c->entry);
-	fr_dlist_insert_tail(&t->active, &c->entry);
+	if (!request) {
+		packet->data = talloc_memdup(packet, link->msg->packet, link->msg->packet_len);
+		if (!packet->data) goto error;
+		packet->data_len = link->msg->packet_len;
+
+		packet->data[1] = link->id;
+		if (fr_radius_sign(packet->data, NULL, (uint8_t const *) inst->secret,
+				   inst->secret_len, NULL) < 0) goto error;
+
+		packet->code = packet->data[0];
+		packet->id = link->id;
+		memcpy(packet->vector, packet->data + 4, sizeof(packet->vector));
+
+		link->packet = packet;
+		return 0;
+	}
+
+	packet->code = request->packet->code;
+	packet->id = link->id;
 
 	/*
-	 *	If we have data pending, add the writable event immediately
+	 *	Access-Request packets use the random vector as the
+	 *	Request Authenticator.
 	 */
-	if (c->pending) {
-		mod_radius_fd_active(c);
-	} else {
-		mod_radius_fd_idle(c);
+	memcpy(buffer + 4, packet->vector, sizeof(packet->vector));
+
+	packet_len = fr_radius_encode(buffer, sizeof(buffer), NULL, inst->secret, inst->secret_len,
+				      packet->code, packet->id, request->packet->vps);
+	if (packet_len < 0) {
+	error:
+		talloc_free(packet);
+		return -1;
 	}
 
-	return FR_CONNECTION_STATE_CONNECTED;
+	if (fr_radius_sign(buffer, NULL, (uint8_t const *) inst->secret, inst->secret_len, NULL) < 0) goto error;
+
+	packet->data = talloc_memdup(packet, buffer, packet_len);
+	if (!packet->data) goto error;
+	packet->data_len = packet_len;
+	memcpy(packet->vector, packet->data + 4, sizeof(packet->vector));
+
+	link->packet = packet;
+
+	return 0;
 }
 
-/** Initialise a new outbound connection
+/** Encode a copy of a request, with ID 0, and without signing it
  *
- * @param[out] fd_out	Where to write the new file descriptor.
- * @param[in] uctx	A #rlm_radius_thread_t.
+ * For packets which are sent later, by another thread.
  */
-static fr_connection_state_t mod_radius_conn_init(int *fd_out, void *uctx)
+static ssize_t mod_encode_copy(rlm_radius_t const *inst, REQUEST *request, uint8_t *buffer, size_t buffer_len)
 {
-	rlm_radius_connection_t	*c = talloc_get_type_abort(uctx, rlm_radius_connection_t);
-	rlm_radius_thread_t	*t = c->thread;
-	rlm_radius_t const	*inst = t->inst;
+	RADIUS_PACKET	*packet;
+	ssize_t		packet_len;
 
-	memset(c->client_io_ctx, 0, inst->client_io->io_inst_size);
+	packet = fr_radius_alloc(request, true);
+	if (!packet) return -1;
+
+	memcpy(buffer + 4, packet->vector, sizeof(packet->vector));
+	talloc_free(packet);
 
-	return inst->client_io->init(fd_out, c->client_io_ctx);
+	packet_len = fr_radius_encode(buffer, buffer_len, NULL, inst->secret, inst->secret_len,
+				      request->packet->code, 0, request->packet->vps);
+	if (packet_len < 0) return -1;
+
+	return packet_len;
 }
 
+/** Move all of a connection's requests back to its home server
+ *
+ * Their IDs belong to this connection, so they're re-encoded when
+ * they're sent again.
+ */
+static void mod_radius_conn_requeue(rlm_radius_connection_t *c)
+{
+	rlm_radius_home_t	*home = c->home;
+	fr_dlist_t		*entry, *next;
+
+	for (entry = FR_DLIST_FIRST(c->sent);
+	     entry != NULL;
+	     entry = next) {
+		rlm_radius_link_t *link;
 
-/** The connection is beign free'd
+		link = fr_ptr_to_type(rlm_radius_link_t, entry, entry);
+
+		next = FR_DLIST_NEXT(c->sent, entry);
+
+		rad_assert(link->waiting == true);
+
+		mod_link_requeue(link);
+
+		// @todo - insert into the list by when we first sent
+		// the packet, so that earlier packets are handled
+		// before later packets
+		fr_dlist_insert_tail(&home->queued, &link->entry);
+
+		home->pending = true;
+	}
+
+	for (entry = FR_DLIST_FIRST(c->queued);
+	     entry != NULL;
+	     entry = next) {
+		rlm_radius_link_t *link;
+
+		link = fr_ptr_to_type(rlm_radius_link_t, entry, entry);
+
+		next = FR_DLIST_NEXT(c->queued, entry);
+
+		rad_assert(link->waiting == false);
+
+		mod_link_requeue(link);
+
+		fr_dlist_insert_tail(&home->queued, &link->entry);
+
+		home->pending = true;
+	}
+}
+
+/** Mark a connection as zombie
+ *
+ * Its requests go to other connections immediately, and we probe the
+ * home server with Status-Server until it replies again.
  */
-static int mod_radius_conn_free(rlm_radius_connection_t *c)
+static void mod_radius_conn_zombie(rlm_radius_connection_t *c)
 {
-	fr_dlist_t *entry, *next;
-	rlm_radius_thread_t *t = c->thread;
+	rlm_radius_home_t	*home = c->home;
+
+	WARN("No replies from home server %s, marking connection zombie - %s",
+	     home->home_server->name, c->name);
+
+	fr_dlist_remove(&c->entry);
+	fr_dlist_insert_tail(&home->frozen, &c->entry);
+	home->num_free -= c->num_free;
+	c->active = false;
+	c->zombie = true;
+	home->num_zombie++;
+	if (c->idle_ev) (void) fr_event_timer_delete(c->el, &c->idle_ev);
+
+	mod_radius_conn_requeue(c);
+
+	c->pending = false;
+	mod_radius_fd_idle(c);
+
+	mod_status_start(c);
+
+	if (home->pending) mod_clear_backlog(home);
+
+	mod_connection_check(home);
+}
+
+/** Revive a zombie connection
+ *
+ */
+static void mod_radius_conn_revive(rlm_radius_connection_t *c)
+{
+	rlm_radius_home_t	*home = c->home;
+
+	INFO("Home server %s is replying again, reviving connection - %s",
+	     home->home_server->name, c->name);
+
+	if (c->status_ev) (void) fr_event_timer_delete(c->el, &c->status_ev);
+	TALLOC_FREE(c->status_packet);
+
+	fr_dlist_remove(&c->entry);
+	fr_dlist_insert_tail(&home->active, &c->entry);
+	c->active = true;
+	c->zombie = false;
+	home->num_zombie--;
+	home->num_free += c->num_free;
+
+	c->unanswered = 0;
+	c->last_reply = fr_time();
+
+	if (home->pending) mod_clear_backlog(home);
+}
+
+/** Check whether a connection has stopped replying
+ *
+ * That's either "unanswered" requests timing out in a row, or no
+ * replies at all since the oldest outstanding packet was sent,
+ * "period" ago.
+ *
+ * @return
+ *	- true if the connection is now zombie.
+ *	- false if it's still usable.
+ */
+static bool mod_zombie_check(rlm_radius_connection_t *c, fr_time_t now)
+{
+	rlm_radius_t const	*inst = c->inst;
+	fr_dlist_t		*entry;
+	rlm_radius_link_t	*link;
+
+	if (!c->active) return false;
+
+	if (c->unanswered >= inst->max_unanswered) goto zombie;
+
+	entry = FR_DLIST_FIRST(c->sent);
+	if (!entry) return false;
+
+	link = fr_ptr_to_type(rlm_radius_link_t, entry, entry);
+	if (c->last_reply > link->sent) return false;
+
+	if ((now - link->sent) < inst->zombie_period_time) return false;
+
+zombie:
+	mod_radius_conn_zombie(c);
+	return true;
+}
+
+/** Send a Status-Server probe on a zombie connection
+ *
+ * The probe only has a Message-Authenticator, which is all that
+ * RFC 5997 requires.
+ */
+static void mod_status_send(rlm_radius_connection_t *c)
+{
+	rlm_radius_t const	*inst = c->inst;
+	RADIUS_PACKET		*packet;
+	uint8_t			buffer[RADIUS_HDR_LEN + 2 + AUTH_VECTOR_LEN];
+
+	TALLOC_FREE(c->status_packet);
+	c->status_replied = false;
+
+	packet = fr_radius_alloc(c, true);
+	if (!packet) return;
+
+	packet->code = FR_CODE_STATUS_SERVER;
+	packet->id = c->status_id++;
+
+	buffer[0] = packet->code;
+	buffer[1] = packet->id;
+	buffer[2] = 0;
+	buffer[3] = sizeof(buffer);
+	memcpy(buffer + 4, packet->vector, sizeof(packet->vector));
+
+	buffer[RADIUS_HDR_LEN] = FR_MESSAGE_AUTHENTICATOR;
+	buffer[RADIUS_HDR_LEN + 1] = 2 + AUTH_VECTOR_LEN;
+	memset(buffer + RADIUS_HDR_LEN + 2, 0, AUTH_VECTOR_LEN);
+
+	if (fr_radius_sign(buffer, NULL, (uint8_t const *) inst->secret, inst->secret_len, NULL) < 0) {
+	error:
+		PERROR("Failed creating Status-Server - %s", c->name);
+		talloc_free(packet);
+		return;
+	}
+
+	packet->data = talloc_memdup(packet, buffer, sizeof(buffer));
+	if (!packet->data) goto error;
+	packet->data_len = sizeof(buffer);
+
+	c->status_packet = packet;
+
+	DEBUG2("Sending Status-Server ID %u - %s", packet->id, c->name);
+	c->status_sent = fr_time();
+
+	/*
+	 *	If the socket is full, this probe counts as
+	 *	unanswered.
+	 */
+	if (inst->client_io->write(fr_connection_get_fd(c->conn), c->client_io_ctx,
+				   packet->data, packet->data_len) < 0) {
+		PERROR("Failed writing to socket - %s", c->name);
+		fr_connection_reconnect(c->conn);
+		return;
+	}
+
+	/*
+	 *	Stream transports may not have written all of it.
+	 */
+	if (inst->client_io->flush) mod_radius_fd_active(c);
+}
+
+/** Send the next Status-Server probe
+ *
+ * Each probe which isn't answered doubles the delay before the next
+ * one, up to "max_check_interval".
+ */
+static void mod_status_timer(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	rlm_radius_connection_t	*c = talloc_get_type_abort(uctx, rlm_radius_connection_t);
+	rlm_radius_t const	*inst = c->inst;
+	struct timeval		when;
+
+	if (!c->status_replied) {
+		c->num_answers = 0;
+
+		fr_timeval_add(&c->status_interval, &c->status_interval, &c->status_interval);
+		if (timercmp(&c->status_interval, &inst->max_check_interval, >)) {
+			c->status_interval = inst->max_check_interval;
+		}
+	} else {
+		c->status_interval = inst->check_interval;
+	}
+
+	gettimeofday(&when, NULL);
+	fr_timeval_add(&when, &when, &c->status_interval);
+
+	if (fr_event_timer_insert(c, c->el, &c->status_ev, &when, mod_status_timer, c) < 0) {
+		PERROR("Failed inserting Status-Server timer");
+	}
+
+	mod_status_send(c);
+}
+
+/** Start probing a zombie connection
+ *
+ */
+static void mod_status_start(rlm_radius_connection_t *c)
+{
+	rlm_radius_t const	*inst = c->inst;
+	struct timeval		when;
+
+	c->num_answers = 0;
+	c->status_interval = inst->check_interval;
+
+	gettimeofday(&when, NULL);
+	fr_timeval_add(&when, &when, &c->status_interval);
+
+	if (fr_event_timer_insert(c, c->el, &c->status_ev, &when, mod_status_timer, c) < 0) {
+		PERROR("Failed inserting Status-Server timer");
+	}
+
+	mod_status_send(c);
+}
+
+/** Process a reply to a Status-Server probe
+ *
+ * The connection is revived after "num_answers_to_alive" probes in a
+ * row are answered.
+ */
+static void mod_status_reply(rlm_radius_connection_t *c, uint8_t *data)
+{
+	rlm_radius_t const	*inst = c->inst;
+
+	if (c->status_replied) return;
+
+	if (fr_radius_verify(data, c->status_packet->data,
+			     (uint8_t const *) inst->secret, inst->secret_len, NULL) < 0) {
+		DEBUG("Ignoring reply to Status-Server ID %u - %s: %s", data[1], c->name, fr_strerror());
+		return;
+	}
+
+	c->status_replied = true;
+	c->num_answers++;
+	mod_rtt_update(&c->rtt, fr_time() - c->status_sent);
+
+	DEBUG2("Received reply to Status-Server ID %u (%u of %u) - %s", data[1],
+	       c->num_answers, inst->num_answers_to_alive, c->name);
+
+	if (c->num_answers >= inst->num_answers_to_alive) mod_radius_conn_revive(c);
+}
+
+/** Decode a reply into the request, and resume it
+ *
+ * @param[in] inst	of the module.
+ * @param[in] primary	the link the request yielded on.
+ * @param[in] original	the packet we sent.
+ * @param[in] name	of the connection, for debug messages.
+ * @param[in] data	the reply.
+ * @param[in] data_len	of the reply.
+ */
+static void mod_reply_decode(rlm_radius_t const *inst, rlm_radius_link_t *primary, RADIUS_PACKET *original,
+			     char const *name, uint8_t *data, size_t data_len)
+{
+	REQUEST			*request = primary->request;
+	RADIUS_PACKET		*reply;
+
+	reply = fr_radius_alloc(request, false);
+	if (!reply) {
+	fail:
+		primary->rcode = RLM_MODULE_FAIL;
+		unlang_resumable(request);
+		return;
+	}
+
+	reply->data = talloc_memdup(reply, data, data_len);
+	if (!reply->data) {
+		talloc_free(reply);
+		goto fail;
+	}
+	reply->data_len = data_len;
+	reply->code = data[0];
+	reply->id = data[1];
+	memcpy(reply->vector, data + 4, sizeof(reply->vector));
+
+	if (fr_radius_packet_decode(reply, original, inst->secret) < 0) {
+		RPEDEBUG("Failed decoding reply");
+		talloc_free(reply);
+		goto fail;
+	}
+
+	RDEBUG("Received %s ID %u - %s", fr_packet_codes[reply->code], reply->id, name);
+
+	switch (reply->code) {
+	case FR_CODE_ACCESS_ACCEPT:
+	case FR_CODE_ACCOUNTING_RESPONSE:
+	case FR_CODE_COA_ACK:
+	case FR_CODE_DISCONNECT_ACK:
+		primary->rcode = RLM_MODULE_OK;
+		break;
+
+	case FR_CODE_ACCESS_CHALLENGE:
+		primary->rcode = RLM_MODULE_UPDATED;
+		break;
+
+	case FR_CODE_ACCESS_REJECT:
+	case FR_CODE_COA_NAK:
+	case FR_CODE_DISCONNECT_NAK:
+		primary->rcode = RLM_MODULE_REJECT;
+		break;
+
+	default:
+		REDEBUG("Invalid reply code %u", reply->code);
+		talloc_free(reply);
+		goto fail;
+	}
+
+	mod_followers_reply(primary, reply);
+
+	request->reply->code = reply->code;
+	fr_pair_list_move(request->reply, &request->reply->vps, &reply->vps);
+	talloc_free(reply);
+
+	unlang_resumable(request);
+}
+
+/** Process a reply from the home server
+ *
+ */
+static void mod_radius_reply(rlm_radius_connection_t *c, uint8_t *data, size_t data_len)
+{
+	rlm_radius_t const	*inst = c->inst;
+	rlm_radius_link_t	*link, *primary;
+	REQUEST			*request;
+	decode_fail_t		reason;
+	fr_time_t		rtt;
+
+	if (!fr_radius_ok(data, &data_len, false, &reason)) {
+		DEBUG("Ignoring invalid packet - %s", c->name);
+		return;
+	}
+
+	/*
+	 *	Zombie connections only have Status-Server probes
+	 *	outstanding.
+	 */
+	if (c->status_packet && (data[1] == c->status_packet->id)) {
+		mod_status_reply(c, data);
+		return;
+	}
+
+	link = c->id[data[1]];
+	if (!link || !link->waiting) {
+		DEBUG("Ignoring reply with unknown ID %u - %s", data[1], c->name);
+		return;
+	}
+	request = link->request;
+
+	if (fr_radius_verify(data, link->packet->data,
+			     (uint8_t const *) inst->secret, inst->secret_len, NULL) < 0) {
+		ROPTIONAL(RPEDEBUG, PERROR, "Ignoring reply with ID %u", data[1]);
+		return;
+	}
+
+	/*
+	 *	Keep track of how quickly the home server and the
+	 *	connection are replying.
+	 */
+	c->last_reply = fr_time();
+	c->unanswered = 0;
+
+	rtt = c->last_reply - link->sent;
+	FR_PROBE4(radius_receive, request ? request->number : 0, c->home->home_server->name, data[0], rtt);
+	mod_rtt_update(&c->rtt, rtt);
+	mod_rtt_update(&c->home->rtt, rtt);
+	if (inst->hedge_mode == RLM_RADIUS_HEDGE_DELAYED) mod_hedge_sample(c->home, rtt);
+	if (c->home->metrics) {
+		fr_metric_inc(c->home->metrics, HOME_METRIC_RESPONSES);
+		fr_metric_time(c->home->metrics, HOME_METRIC_LATENCY, rtt);
+	}
+
+	/*
+	 *	The worker decodes the reply.
+	 */
+	if (!request) {
+		memcpy(link->msg->vector, link->packet->vector, sizeof(link->msg->vector));
+		link->msg->reply = talloc_memdup(link->msg, data, data_len);
+		if (link->msg->reply) link->msg->reply_len = data_len;
+
+		link->msg->name = talloc_strdup(link->msg, c->name);
+		mod_shared_done(link);
+		return;
+	}
+
+	/*
+	 *	The reply is for this request, so the ID can be used
+	 *	for another one.  If the request was hedged, the first
+	 *	reply wins, and the other copy is cancelled.
+	 */
+	primary = mod_link_finish(link);
+
+	mod_reply_decode(inst, primary, link->packet, c->name, data, data_len);
+}
+
+/** Read replies from the home server
+ *
+ */
+static void mod_radius_conn_read(UNUSED fr_event_list_t *el, int sock, UNUSED int flags, void *uctx)
+{
+	rlm_radius_connection_t	*c = talloc_get_type_abort(uctx, rlm_radius_connection_t);
+	rlm_radius_t const	*inst = c->inst;
+	ssize_t			data_len;
+	int			i, num, total;
+	uint8_t			buffer[MAX_PACKET_LEN];
+	struct iovec		iov[RLM_RADIUS_BATCH_MAX];
+
+	/*
+	 *	There can't be more replies than there are IDs.
+	 */
+	if (!inst->client_io->read_batch) {
+		for (i = 0; i < RLM_RADIUS_MAX_IDS; i++) {
+			data_len = inst->client_io->read(sock, c->client_io_ctx, buffer, sizeof(buffer));
+			if (data_len == 0) break;
+
+			if (data_len < 0) {
+			error:
+				PERROR("Failed reading from socket - %s", c->name);
+				fr_connection_reconnect(c->conn);
+				return;
+			}
+
+			mod_radius_reply(c, buffer, data_len);
+		}
+
+		/*
+		 *	Reading may have given a stream transport more
+		 *	to write, e.g. the rest of a TLS handshake.
+		 */
+		if (inst->client_io->flush) {
+			int rcode;
+
+			rcode = inst->client_io->flush(sock, c->client_io_ctx);
+			if (rcode < 0) {
+				PERROR("Failed writing to socket - %s", c->name);
+				fr_connection_reconnect(c->conn);
+				return;
+			}
+
+			if (rcode > 0) mod_radius_fd_active(c);
+		}
+		return;
+	}
+
+	/*
+	 *	Read as many replies as we can with each system
+	 *	call, into the thread's receive buffer.
+	 */
+	for (total = 0; total < RLM_RADIUS_MAX_IDS; total += num) {
+		for (i = 0; i < RLM_RADIUS_BATCH_MAX; i++) {
+			iov[i].iov_base = c->thread->rx_buffer + (i * MAX_PACKET_LEN);
+			iov[i].iov_len = MAX_PACKET_LEN;
+		}
+
+		num = inst->client_io->read_batch(sock, c->client_io_ctx, iov, RLM_RADIUS_BATCH_MAX);
+		if (num == 0) return;
+		if (num < 0) goto error;
+
+		for (i = 0; i < num; i++) {
+			if (!iov[i].iov_len) continue;
+
+			mod_radius_reply(c, iov[i].iov_base, iov[i].iov_len);
+		}
+
+		if (num < RLM_RADIUS_BATCH_MAX) return;
+	}
+}
+
+/** Write packets to the socket
+ *
+ * @return
+ *	- >=0 the number of packets written.
+ *	- <0 on error.
+ */
+static int mod_radius_conn_write(rlm_radius_connection_t *c, int sock, struct iovec *packets, int num)
+{
+	rlm_radius_t const	*inst = c->inst;
+	ssize_t			rcode;
+	int			i;
+
+	if (inst->client_io->write_batch) return inst->client_io->write_batch(sock, c->client_io_ctx, packets, num);
+
+	for (i = 0; i < num; i++) {
+		rcode = inst->client_io->write(sock, c->client_io_ctx, packets[i].iov_base, packets[i].iov_len);
+		if (rcode == 0) break;
+
+		if (rcode < 0) {
+			if (i == 0) return -1;
+			break;
+		}
+	}
+
+	return i;
+}
+
+/** There's space available to write data, so do that...
+ *
+ * All of the queued packets are encoded, and then written with as
+ * few system calls as the transport allows.
+ */
+static void mod_radius_conn_writable(UNUSED fr_event_list_t *el, int sock, UNUSED int flags, void *uctx)
+{
+	rlm_radius_connection_t	*c = talloc_get_type_abort(uctx, rlm_radius_connection_t);
+	rlm_radius_t const	*inst = c->inst;
+	fr_dlist_t		*entry, *next;
+	rlm_radius_link_t	*batch[RLM_RADIUS_BATCH_MAX];
+	struct iovec		iov[RLM_RADIUS_BATCH_MAX];
+	int			i, num, sent;
+	fr_time_t		now;
+
+	/*
+	 *	Stream transports may still have part of an earlier
+	 *	batch to write.  The data has to go out in order, so
+	 *	nothing else is written until it's gone.
+	 */
+	if (inst->client_io->flush) {
+		int rcode;
+
+		rcode = inst->client_io->flush(sock, c->client_io_ctx);
+		if (rcode < 0) {
+			PERROR("Failed writing to socket - %s", c->name);
+			fr_connection_reconnect(c->conn);
+			return;
+		}
+
+		if (rcode > 0) return;
+	}
+
+	/*
+	 *	Don't send more packets to a home server which has
+	 *	stopped replying.
+	 */
+	if (mod_zombie_check(c, fr_time())) return;
+
+	for (;;) {
+		num = 0;
+
+		for (entry = FR_DLIST_FIRST(c->queued);
+		     (entry != NULL) && (num < RLM_RADIUS_BATCH_MAX);
+		     entry = next) {
+			rlm_radius_link_t	*link;
+			REQUEST			*request;
+
+			link = fr_ptr_to_type(rlm_radius_link_t, entry, entry);
+			request = link->request;
+
+			next = FR_DLIST_NEXT(c->queued, entry);
+
+			if (!link->packet && (mod_encode(inst, link) < 0)) {
+				ROPTIONAL(RPEDEBUG, PERROR, "Failed encoding packet");
+				mod_link_fail(link);
+				continue;
+			}
+
+			batch[num] = link;
+			iov[num].iov_base = link->packet->data;
+			iov[num].iov_len = link->packet->data_len;
+			num++;
+		}
+
+		if (!num) break;
+
+		sent = mod_radius_conn_write(c, sock, iov, num);
+		if (sent < 0) {
+			PERROR("Failed writing to socket - %s", c->name);
+			fr_connection_reconnect(c->conn);
+			return;
+		}
+
+		now = fr_time();
+
+		for (i = 0; i < sent; i++) {
+			rlm_radius_link_t	*link = batch[i];
+			REQUEST			*request = link->request;
+
+			ROPTIONAL(RDEBUG, DEBUG, "Sent %s ID %i - %s",
+				  fr_packet_codes[link->packet->code], link->id, c->name);
+			FR_PROBE4(radius_send, request ? request->number : 0, c->home->home_server->name,
+				  link->packet->code, link->id);
+
+			fr_dlist_remove(&link->entry);
+			fr_dlist_insert_tail(&c->sent, &link->entry);
+			link->waiting = true;
+			link->sent = now;
+			c->waiting++;
+		}
+
+		/*
+		 *	The socket is full.  Wait for it to become
+		 *	writable again.
+		 */
+		if (sent < num) return;
+	}
+
+	c->pending = false;
+
+	/*
+	 *	Everything has been given to the transport, but it
+	 *	may not all be on the wire yet.
+	 */
+	if (inst->client_io->flush) {
+		int rcode;
+
+		rcode = inst->client_io->flush(sock, c->client_io_ctx);
+		if (rcode < 0) {
+			PERROR("Failed writing to socket - %s", c->name);
+			fr_connection_reconnect(c->conn);
+			return;
+		}
+
+		if (rcode > 0) return;
+	}
+
+	mod_radius_fd_idle(c);
+}
+
+/** Set the socket to idle
+ *
+ *  But keep the read event open, just in case the other end sends us
+ *  data  That way we can process it.
+ *
+ * @param[in] c		Connection data structure
+ */
+static void mod_radius_fd_idle(rlm_radius_connection_t *c)
+{
+	DEBUG3("Marking socket (%i) as idle", fr_connection_get_fd(c->conn));
+	if (fr_event_fd_insert(c, c->el, fr_connection_get_fd(c->conn),
+			       mod_radius_conn_read, NULL, mod_radius_conn_error, c) < 0) {
+		PERROR("Failed inserting FD event");
+	}
+}
+
+/** Set the socket to active
+ *
+ * We have messages we want to send, so need to know when the socket is writable.
+ *
+ * @param[in] c		Connection data structure
+ */
+static void mod_radius_fd_active(rlm_radius_connection_t *c)
+{
+	DEBUG3("Marking socket (%i) as active - Draining requests", fr_connection_get_fd(c->conn));
+	if (fr_event_fd_insert(c, c->el, fr_connection_get_fd(c->conn),
+			       mod_radius_conn_read, mod_radius_conn_writable, mod_radius_conn_error, c) < 0) {
+		PERROR("Failed inserting FD event");
+	}
+}
+
+/** Connection errored
+ *
+ */
+static void mod_radius_conn_error(UNUSED fr_event_list_t *el, int sock, UNUSED int flags, int fd_errno, void *uctx)
+{
+	rlm_radius_connection_t	*c = talloc_get_type_abort(uctx, rlm_radius_connection_t);
+
+	ERROR("Connection failed (%i): %s", sock, fr_syserror(fd_errno));
+
+	/*
+	 *	Something bad happened... Fix it.  The connection API
+	 *	will take care of deleting the FD from the event list,
+	 *	and will call our mod_radius_conn_close() routine.
+	 */
+	fr_connection_reconnect(c->conn);
+}
+
+/** Deal with a failure case.
+ *
+ */
+static fr_connection_state_t mod_radius_conn_failed(UNUSED int fd, fr_connection_state_t prev, void *uctx)
+{
+	rlm_radius_connection_t	*c = talloc_get_type_abort(uctx, rlm_radius_connection_t);
+	rlm_radius_home_t	*home = c->home;
+	fr_dlist_t		*entry, *next;
+
+	/*
+	 *	If it's not trying to reconnect, trash the entire
+	 *	connection.
+	 */
+	if (prev != FR_CONNECTION_STATE_CONNECTED) {
+		talloc_free(c);
+		return FR_CONNECTION_STATE_HALTED;
+	}
+
+	/*
+	 *	Remove the connection from whatever list it's in, and
+	 *	add it to the "closed" list.  Its IDs can't be used
+	 *	until it's open again.
+	 */
+	fr_dlist_remove(&c->entry);
+	fr_dlist_insert_tail(&home->closed, &c->entry);
+	if (c->active) {
+		home->num_free -= c->num_free;
+		c->active = false;
+	}
+	if (c->idle_ev) (void) fr_event_timer_delete(c->el, &c->idle_ev);
+
+	/*
+	 *	A zombie connection stays zombie, but we only probe
+	 *	it once it's open again.
+	 */
+	if (c->status_ev) (void) fr_event_timer_delete(c->el, &c->status_ev);
+	TALLOC_FREE(c->status_packet);
+
+	/*
+	 *	Move any requests from the "sent" back to the
+	 *	"queued" list.  They keep their IDs.
+	 */
+	for (entry = FR_DLIST_FIRST(c->sent);
+	     entry != NULL;
+	     entry = next) {
+		rlm_radius_link_t *link;
+
+		link = fr_ptr_to_type(rlm_radius_link_t, entry, entry);
+
+		next = FR_DLIST_NEXT(c->sent, entry);
+
+		rad_assert(link->waiting == true);
+		link->waiting = false;
+		c->waiting--;
+
+		fr_dlist_remove(&link->entry);
+
+		// @todo - insert into the list by when we first sent
+		// the packet, so that earlier packets are handled
+		// before later packets
+		fr_dlist_insert_tail(&c->queued, &link->entry);
+
+		c->pending = true;
+	}
+
+	/*
+	 *	Once the connection is open again, the pending queue
+	 *	will be automatically cleared by the "open" callback.
+	 */
+
+	return FR_CONNECTION_STATE_INIT;
+}
+
+/** Process notification that fd is open
+ *
+ */
+static fr_connection_state_t mod_radius_conn_open(int fd, fr_event_list_t *el, void *uctx)
+{
+	rlm_radius_connection_t	*c = talloc_get_type_abort(uctx, rlm_radius_connection_t);
+	rlm_radius_home_t	*home = c->home;
+	rlm_radius_t const	*inst = c->inst;
+
+	/*
+	 *	Let the transport finish setting up the connection,
+	 *	e.g. with a TLS handshake.
+	 */
+	if (inst->client_io->open &&
+	    (inst->client_io->open(fd, el, c->client_io_ctx) != FR_CONNECTION_STATE_CONNECTED)) {
+		PERROR("Failed opening connection to %s", home->home_server->name);
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	c->name = inst->client_io->get_name(c, c->client_io_ctx);
+
+	DEBUG2("Connected - %s", c->name);
+
+	fr_dlist_remove(&c->entry);
+
+	/*
+	 *	A new socket doesn't mean that the home server is
+	 *	replying.  Keep probing it.
+	 */
+	if (c->zombie) {
+		fr_dlist_insert_tail(&home->frozen, &c->entry);
+		mod_radius_fd_idle(c);
+		mod_status_start(c);
+		return FR_CONNECTION_STATE_CONNECTED;
+	}
+
+	/*
+	 *	Remove the connection from the "closed" list, and add
+	 *	it to the "active" list.
+	 */
+	fr_dlist_insert_tail(&home->active, &c->entry);
+	c->active = true;
+	home->num_free += c->num_free;
+
+	/*
+	 *	Give the new IDs to any requests which are waiting
+	 *	for them.
+	 */
+	if (home->pending) mod_clear_backlog(home);
+
+	/*
+	 *	If we have data pending, add the writable event
+	 *	immediately.  Stream transports may also have data of
+	 *	their own to write, e.g. the start of a TLS handshake.
+	 */
+	if (c->pending ||
+	    (inst->client_io->flush && (inst->client_io->flush(fd, c->client_io_ctx) != 0))) {
+		mod_radius_fd_active(c);
+	} else {
+		mod_radius_fd_idle(c);
+	}
+
+	/*
+	 *	We may still be short of IDs.
+	 */
+	mod_connection_check(home);
+
+	return FR_CONNECTION_STATE_CONNECTED;
+}
+
+/** Initialise a new outbound connection
+ *
+ * @param[out] fd_out	Where to write the new file descriptor.
+ * @param[in] uctx	A #rlm_radius_thread_t.
+ */
+static fr_connection_state_t mod_radius_conn_init(int *fd_out, void *uctx)
+{
+	rlm_radius_connection_t	*c = talloc_get_type_abort(uctx, rlm_radius_connection_t);
+	rlm_radius_t const	*inst = c->inst;
+
+	memset(c->client_io_ctx, 0, inst->client_io->io_inst_size);
+
+	return inst->client_io->init(fd_out, c->client_io_ctx, c->home->home_server->client_io_instance);
+}
+
+/** Close an outbound connection
+ *
+ */
+static void mod_radius_conn_close(int fd, void *uctx)
+{
+	rlm_radius_connection_t	*c = talloc_get_type_abort(uctx, rlm_radius_connection_t);
+
+	c->inst->client_io->close(fd, c->client_io_ctx);
+}
+
+
+/** The connection is beign free'd
+ */
+static int mod_radius_conn_free(rlm_radius_connection_t *c)
+{
+	rlm_radius_home_t *home = c->home;
+
+	/*
+	 *	Remove us from whatever list we're in.
+	 */
+	fr_dlist_remove(&c->entry);
+	if (c->active) {
+		home->num_free -= c->num_free;
+		c->active = false;
+	}
+	home->num_connections--;
+
+	if (c->zombie) home->num_zombie--;
+
+	/*
+	 *	Move any requests back to the home server "queued"
+	 *	list, so that other connections can send them.
+	 */
+	mod_radius_conn_requeue(c);
+
+	if (home->pending) mod_clear_backlog(home);
+
+	return 0;
+}
+
+/** Open a new connection
+ *
+ * The connection is added to the "closed" list until it's open.
+ */
+static int mod_radius_conn_alloc(rlm_radius_home_t *home)
+{
+	rlm_radius_thread_t	*t = home->thread;
+	rlm_radius_t const	*inst = t->inst;
+	rlm_radius_connection_t	*c;
+	int			i;
+
+	c = talloc_zero(t, rlm_radius_connection_t);
+	if (!c) return -1;
+
+	c->name = "<pending>";
+	c->inst = inst;
+	c->thread = t;
+	c->home = home;
+	c->el = t->el;
+
+	FR_DLIST_INIT(c->entry);
+	FR_DLIST_INIT(c->queued);
+	FR_DLIST_INIT(c->sent);
+
+	for (i = 0; i < (RLM_RADIUS_MAX_IDS / 64); i++) c->id_free[i] = ~((uint64_t) 0);
+	c->num_free = RLM_RADIUS_MAX_IDS;
+
+	c->client_io_ctx = talloc_zero_array(c, uint8_t, inst->client_io->io_inst_size);
+	if (!c->client_io_ctx) {
+		talloc_free(c);
+		return -1;
+	}
+
+	/*
+	 *	This opens the outbound connection
+	 */
+	c->conn = fr_connection_alloc(c, t->el, &inst->connection_timeout, &inst->reconnection_delay,
+				      mod_radius_conn_init, mod_radius_conn_open, mod_radius_conn_close,
+				      home->home_server->name, c);
+	if (c->conn == NULL) {
+		talloc_free(c);
+		return -1;
+	}
+
+	/*
+	 *	We have to catch errors on failed.
+	 */
+	fr_connection_failed_func(c->conn, mod_radius_conn_failed);
+
+	/*
+	 *	Add the connection to the "closed" list, because it's
+	 *	not open, and there are no requests outstanding on it.
+	 */
+	fr_dlist_insert_tail(&home->closed, &c->entry);
+	home->num_connections++;
+
+	talloc_set_destructor(c, mod_radius_conn_free);
+
+	fr_connection_start(c->conn);
+
+	return 0;
+}
+
+/** Unlink a request from wherever it is
+ *
+ */
+static int mod_link_free(rlm_radius_link_t *link)
+{
+	mod_link_release(link);
+	mod_inflight_remove(link);
+
+	/*
+	 *	In the I/O thread, mod_shared_done() has already
+	 *	given the followers back to their workers.
+	 */
+	if (link->request) mod_followers_fail(link);
+
+	return 0;
+}
+
+/** Add a request to a connection, giving it one of the connection's IDs
+ *
+ */
+static void CC_HINT(nonnull) mod_add(rlm_radius_connection_t *c, rlm_radius_link_t *link)
+{
+	rad_assert(c->num_free > 0);
+
+	link->c = c;
+	link->id = mod_id_alloc(c);
+	c->id[link->id] = link;
+	link->waiting = false;
+
+	fr_dlist_insert_tail(&c->queued, &link->entry);
+
+	/*
+	 *	If there are no pending writes, enable the write
+	 *	callback.  It will wake up and write the packets to
+	 *	the socket.
+	 */
+	if (!c->pending) {
+		c->pending = true;
+		mod_radius_fd_active(c);
+	}
+}
+
+/** No reply was received in time
+ *
+ */
+static void mod_response_timeout(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+				 UNUSED struct timeval *fired)
+{
+	rlm_radius_link_t	*link = talloc_get_type_abort(ctx, rlm_radius_link_t);
+	rlm_radius_connection_t	*c = link->waiting ? link->c : NULL;
+	rlm_radius_connection_t	*hedge_c = (link->hedge && link->hedge->waiting) ? link->hedge->c : NULL;
+
+	rad_assert(link->home != NULL);
+
+	REDEBUG("No reply from home server %s", link->home->home_server->name);
+
+	/*
+	 *	A home server which doesn't reply is at least this
+	 *	slow.
+	 */
+	mod_rtt_update(&link->home->rtt, fr_time() - link->start);
+	if (link->home->metrics) fr_metric_inc(link->home->metrics, HOME_METRIC_TIMEOUTS);
+
+	(void) mod_link_finish(link);
+	link->rcode = RLM_MODULE_FAIL;
+	unlang_resumable(request);
+
+	/*
+	 *	The packets were sent, and never answered.
+	 */
+	if (c) {
+		c->unanswered++;
+		(void) mod_zombie_check(c, fr_time());
+	}
+
+	if (hedge_c) {
+		hedge_c->unanswered++;
+		(void) mod_zombie_check(hedge_c, fr_time());
+	}
+}
+
+/** Write an accounting request which no home server answered to the spool
+ *
+ * The replay thread signs it, and sends it once a home server is
+ * answering again.
+ */
+static rlm_rcode_t mod_spool_request(rlm_radius_t const *inst, REQUEST *request)
+{
+	ssize_t		packet_len;
+	uint8_t		buffer[MAX_PACKET_LEN];
+
+	packet_len = mod_encode_copy(inst, request, buffer, sizeof(buffer));
+	if (packet_len < 0) {
+		RPEDEBUG("Failed encoding packet for the spool");
+		return RLM_MODULE_FAIL;
+	}
+
+	if (radius_spool_write(inst->spool, buffer, packet_len) < 0) {
+		RPEDEBUG("Failed spooling packet");
+		return RLM_MODULE_FAIL;
+	}
+
+	RDEBUG("Spooled packet, to be replayed later");
+
+	return RLM_MODULE_OK;
+}
+
+/** Return the result of proxying the request
+ *
+ */
+static rlm_rcode_t mod_resume(REQUEST *request, void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_radius_t const	*inst = instance;
+	rlm_radius_link_t	*link = talloc_get_type_abort(ctx, rlm_radius_link_t);
+	rlm_rcode_t		rcode = link->rcode;
+	bool			spool = link->spool;
+
+	talloc_free(link);
+
+	/*
+	 *	Retransmissions from the NAS aren't spooled, as the
+	 *	original request already was.
+	 */
+	if ((rcode == RLM_MODULE_FAIL) && spool && inst->spool &&
+	    (request->packet->code == FR_CODE_ACCOUNTING_REQUEST)) {
+		return mod_spool_request(inst, request);
+	}
+
+	return rcode;
+}
+
+/** Stop proxying a request which is being cancelled
+ *
+ */
+static void mod_signal(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+		       fr_state_action_t action)
+{
+	rlm_radius_link_t *link = talloc_get_type_abort(ctx, rlm_radius_link_t);
+
+	if (action != FR_ACTION_DONE) return;
+
+	(void) mod_link_finish(link);
+	talloc_free(link);
+}
+
+/** Allocate a link for a request
+ *
+ */
+static rlm_radius_link_t *mod_link_alloc(rlm_radius_t const *inst, TALLOC_CTX *ctx, REQUEST *request)
+{
+	rlm_radius_link_t	*link;
+	size_t			size;
+
+	/*
+	 *	The client IO module may need to store per-request
+	 *	data.  Add it here for simpliciy.
+	 */
+	size = sizeof(rlm_radius_link_t);
+	if (inst->client_io->request_inst_size) {
+		size += 15;
+		size &= ~((size_t) 15);
+
+		size += inst->client_io->request_inst_size;
+	}
+
+	link = (rlm_radius_link_t *) talloc_zero_array(ctx, uint64_t, (size + 7) / sizeof(uint64_t));
+	if (!link) return NULL;
+	talloc_set_type(link, rlm_radius_link_t);
+
+	if (size > sizeof(rlm_radius_link_t)) {
+		link->request_io_ctx = (void *) (((uint8_t *) link) + (size - inst->client_io->request_inst_size));
+	}
+
+	link->request = request;
+	link->id = -1;
+	link->rcode = RLM_MODULE_FAIL;
+	link->start = fr_time();
+	FR_DLIST_INIT(link->entry);
+	FR_DLIST_INIT(link->followers);
+
+	talloc_set_destructor(link, mod_link_free);
+
+	return link;
+}
+
+/** Send a request to a home server
+ *
+ */
+static void mod_link_send(rlm_radius_home_t *home, rlm_radius_link_t *link)
+{
+	REQUEST			*request = link->request;
+	rlm_radius_connection_t	*c;
+
+	/*
+	 *	Another connection has closed and moved it's requests
+	 *	back to the home server.  Recycle them through to
+	 *	other connections.
+	 */
+	if (home->pending) {
+		mod_clear_backlog(home);
+	}
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Proxying to home server %s", home->home_server->name);
+
+	link->home = home;
+	home->outstanding++;
+	if (home->metrics) fr_metric_inc(home->metrics, HOME_METRIC_REQUESTS);
+	if (request && request->async && request->async->trace) {
+		fr_trace_peer(request->async->trace, home->home_server->name);
+	}
+
+	/*
+	 *	Use the first connection with a free ID.  If there
+	 *	isn't one, the request waits for the next connection
+	 *	to open.
+	 */
+	c = mod_connection_find(home);
+	if (c) {
+		mod_add(c, link);
+	} else {
+		ROPTIONAL(RDEBUG2, DEBUG2, "No free IDs, waiting for a new connection");
+		fr_dlist_insert_tail(&home->queued, &link->entry);
+		home->pending = true;
+	}
+
+	/*
+	 *	Open another connection before the IDs run out.
+	 */
+	mod_connection_check(home);
+}
+
+/** Send a hedged copy of a request
+ *
+ * Either the first home server hasn't replied within its hedge delay,
+ * or we're hedging every request.
+ */
+static void mod_hedge_send(rlm_radius_thread_t *t, rlm_radius_link_t *hedge)
+{
+	rlm_radius_link_t	*primary = hedge->primary;
+	REQUEST			*request = primary->request;
+	rlm_radius_home_t	*home;
+
+	home = primary->home ? mod_home_select_hedge(t, primary->home) : NULL;
+	if (!home || !mod_hedge_budget(t)) {
+		primary->hedge = NULL;
+		talloc_free(hedge);
+		return;
+	}
+
+	RDEBUG2("Hedging request");
+
+	hedge->start = fr_time();
+	mod_link_send(home, hedge);
+}
+
+/** The first home server hasn't replied, so send the request to another one
+ *
+ */
+static void mod_hedge_timeout(UNUSED REQUEST *request, UNUSED void *instance, void *thread, void *ctx,
+			      UNUSED struct timeval *fired)
+{
+	rlm_radius_link_t	*hedge = talloc_get_type_abort(ctx, rlm_radius_link_t);
+	rlm_radius_thread_t	*t = talloc_get_type_abort(thread, rlm_radius_thread_t);
+
+	mod_hedge_send(t, hedge);
+}
+
+/** Give a request back to the worker which sent it
+ *
+ * This is in the I/O thread.  The request is pushed to the worker
+ * once we're done with this pass through the event loop.
+ */
+static void mod_shared_done(rlm_radius_link_t *link)
+{
+	rlm_radius_shared_msg_t	*msg = link->msg;
+	rlm_radius_shared_t	*shared = msg->worker->shared;
+	fr_dlist_t		*entry;
+
+	/*
+	 *	Retransmissions from the NAS get a copy of the reply.
+	 */
+	while ((entry = FR_DLIST_FIRST(link->followers)) != NULL) {
+		rlm_radius_shared_msg_t *follower;
+
+		follower = fr_ptr_to_type(rlm_radius_shared_msg_t, entry, entry);
+		fr_dlist_remove(&follower->entry);
+
+		if (msg->reply) {
+			follower->reply = talloc_memdup(follower, msg->reply, msg->reply_len);
+			if (follower->reply) follower->reply_len = msg->reply_len;
+		}
+		memcpy(follower->vector, msg->vector, sizeof(follower->vector));
+		if (msg->name) follower->name = talloc_strdup(follower, msg->name);
+
+		fr_dlist_insert_tail(&shared->returning, &follower->entry);
+	}
+
+	link->msg = NULL;
+	talloc_free(link);
+
+	fr_dlist_insert_tail(&shared->returning, &msg->entry);
+}
+
+/** No reply was received in time, in the I/O thread
+ *
+ */
+static void mod_shared_timeout(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	rlm_radius_link_t	*link = talloc_get_type_abort(uctx, rlm_radius_link_t);
+	rlm_radius_connection_t	*c = link->waiting ? link->c : NULL;
+
+	DEBUG("No reply from home server %s", link->home->home_server->name);
+
+	mod_rtt_update(&link->home->rtt, fr_time() - link->start);
+	if (link->home->metrics) fr_metric_inc(link->home->metrics, HOME_METRIC_TIMEOUTS);
+
+	mod_shared_done(link);
+
+	if (c) {
+		c->unanswered++;
+		(void) mod_zombie_check(c, fr_time());
+	}
+}
+
+/** Proxy a request for a worker, in the I/O thread
+ *
+ */
+static void mod_shared_send(rlm_radius_shared_t *shared, rlm_radius_shared_msg_t *msg)
+{
+	rlm_radius_thread_t	*t = shared->thread;
+	rlm_radius_t const	*inst = t->inst;
+	rlm_radius_home_t	*home;
+	rlm_radius_link_t	*link;
+	struct timeval		when;
+
+	/*
+	 *	The request was cancelled while it was queued.
+	 */
+	if (atomic_load(&msg->cancelled)) {
+	done:
+		fr_dlist_insert_tail(&shared->returning, &msg->entry);
+		return;
+	}
+
+	/*
+	 *	The NAS retransmitted a request which we're already
+	 *	proxying, maybe through another worker.  Don't send
+	 *	the home server another copy.
+	 */
+	link = mod_inflight_find(t, &msg->key);
+	if (link) {
+		DEBUG2("Request is a retransmission, waiting for the reply to the original");
+		msg->follower = true;
+		fr_dlist_insert_tail(&link->followers, &msg->entry);
+		return;
+	}
+
+	link = mod_link_alloc(inst, t, NULL);
+	if (!link) goto done;
+
+	link->msg = msg;
+	link->key = msg->key;
+	mod_inflight_insert(t, link);
+
+	gettimeofday(&when, NULL);
+	fr_timeval_add(&when, &when, &inst->response_timeout);
+
+	if (fr_event_timer_insert(link, t->el, &link->ev, &when, mod_shared_timeout, link) < 0) {
+		PERROR("Failed inserting response timer");
+		mod_shared_done(link);
+		return;
+	}
+
+	home = mod_home_select(t);
+	msg->name = home->home_server->name;
+
+	mod_link_send(home, link);
+}
+
+/** A worker has pushed requests to the I/O thread
+ *
+ */
+static void mod_shared_evfilt_user(UNUSED int kq, UNUSED struct kevent const *kev, void *uctx)
+{
+	rlm_radius_shared_t	*shared = uctx;
+	rlm_radius_shared_msg_t	*msg;
+
+	if (atomic_load(&shared->exiting)) {
+		fr_event_loop_exit(shared->el, 1);
+		return;
+	}
+
+	while (fr_atomic_queue_pop(shared->aq, (void **) &msg)) mod_shared_send(shared, msg);
+}
+
+/** Push replies back to the workers, and wake them up
+ *
+ * Each worker is only woken once, no matter how many replies it has.
+ */
+static void mod_shared_post(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	rlm_radius_shared_t	*shared = uctx;
+	fr_dlist_t		*entry;
+
+	entry = FR_DLIST_FIRST(shared->returning);
+	if (!entry) return;
+
+	pthread_mutex_lock(&shared->mutex);
+
+	while ((entry = FR_DLIST_FIRST(shared->returning)) != NULL) {
+		rlm_radius_shared_msg_t *msg;
+
+		msg = fr_ptr_to_type(rlm_radius_shared_msg_t, entry, entry);
+		fr_dlist_remove(&msg->entry);
+
+		if (!msg->worker->alive) {
+			talloc_free(msg);
+			continue;
+		}
+
+		/*
+		 *	Workers limit how many requests they give us,
+		 *	so there's always room for the replies.
+		 */
+		(void) fr_atomic_queue_push(msg->worker->aq, msg);
+		msg->worker->wake = true;
+	}
+
+	for (entry = FR_DLIST_FIRST(shared->workers);
+	     entry != NULL;
+	     entry = FR_DLIST_NEXT(shared->workers, entry)) {
+		rlm_radius_worker_t *worker;
+
+		worker = fr_ptr_to_type(rlm_radius_worker_t, entry, entry);
+		if (!worker->wake) continue;
+
+		worker->wake = false;
+		(void) fr_event_user_trigger(worker->kq, worker->ident);
+	}
+
+	pthread_mutex_unlock(&shared->mutex);
+}
+
+/** Run the event loop for the shared connections
+ *
+ */
+static void *mod_shared_thread(void *arg)
+{
+	rlm_radius_shared_t	*shared = arg;
+
+	DEBUG2("Started I/O thread for %s", shared->thread->inst->name);
+
+	(void) fr_event_loop(shared->el);
+
+	return NULL;
+}
+
+/** No reply from the I/O thread
+ *
+ * The I/O thread normally times out first, and tells us.
+ */
+static void mod_shared_response_timeout(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+					UNUSED struct timeval *fired)
+{
+	rlm_radius_link_t	*link = talloc_get_type_abort(ctx, rlm_radius_link_t);
+
+	REDEBUG("No reply from the I/O thread");
+
+	(void) mod_link_finish(link);
+	link->rcode = RLM_MODULE_FAIL;
+	unlang_resumable(request);
+}
+
+/** Resume a request which the I/O thread has given back
+ *
+ */
+static void mod_worker_reply(rlm_radius_t const *inst, rlm_radius_shared_msg_t *msg)
+{
+	rlm_radius_link_t	*link = msg->link;
+	REQUEST			*request = link->request;
+
+	link->msg = NULL;
+	(void) unlang_event_timeout_delete(request, link);
+
+	if (msg->follower) link->spool = false;
+
+	if (!msg->reply) {
+		REDEBUG("No reply from home server %s", msg->name ? msg->name : "(none)");
+		talloc_free(msg);
+
+		link->rcode = RLM_MODULE_FAIL;
+		unlang_resumable(request);
+		return;
+	}
+
+	/*
+	 *	The I/O thread gave the packet an ID, and signed it
+	 *	again.  Attributes in the reply are encrypted with the
+	 *	new Request Authenticator.
+	 */
+	memcpy(link->packet->vector, msg->vector, sizeof(link->packet->vector));
+
+	mod_reply_decode(inst, link, link->packet, msg->name, msg->reply, msg->reply_len);
+	talloc_free(msg);
+}
+
+/** The I/O thread has pushed replies to us
+ *
+ */
+static void mod_worker_evfilt_user(UNUSED int kq, UNUSED struct kevent const *kev, void *uctx)
+{
+	rlm_radius_thread_t	*t = talloc_get_type_abort(uctx, rlm_radius_thread_t);
+	rlm_radius_worker_t	*worker = t->worker;
+	rlm_radius_shared_msg_t	*msg;
+
+	while (fr_atomic_queue_pop(worker->aq, (void **) &msg)) {
+		worker->outstanding--;
+
+		if (atomic_load(&msg->cancelled)) {
+			talloc_free(msg);
+			continue;
+		}
+
+		mod_worker_reply(t->inst, msg);
+	}
+}
+
+/** Wake up the I/O thread, once per pass through the event loop
+ *
+ */
+static void mod_worker_post(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	rlm_radius_thread_t	*t = talloc_get_type_abort(uctx, rlm_radius_thread_t);
+	rlm_radius_worker_t	*worker = t->worker;
+
+	if (!worker->submitted) return;
+
+	worker->submitted = false;
+	(void) fr_event_user_trigger(worker->shared->kq, worker->shared->ident);
+}
+
+/** Give a request to the I/O thread
+ *
+ * We encode the packet here, so that the I/O thread only has to give
+ * it an ID.
+ */
+static rlm_rcode_t mod_shared_process(rlm_radius_t const *inst, rlm_radius_thread_t *t, REQUEST *request)
+{
+	rlm_radius_worker_t	*worker = t->worker;
+	rlm_radius_link_t	*link;
+	rlm_radius_shared_msg_t	*msg;
+	struct timeval		when, grace = { 1, 0 };
+
+	if (worker->outstanding >= RLM_RADIUS_SHARED_MAX_WORKER) {
+		REDEBUG("Too many requests are waiting for the I/O thread");
+		return RLM_MODULE_FAIL;
+	}
+
+	link = mod_link_alloc(inst, request, request);
+	if (!link) return RLM_MODULE_FAIL;
+
+	link->id = 0;
+	if (mod_encode(inst, link) < 0) {
+		RPEDEBUG("Failed encoding packet");
+		talloc_free(link);
+		return RLM_MODULE_FAIL;
+	}
+	link->id = -1;
+
+	msg = talloc_zero(NULL, rlm_radius_shared_msg_t);
+	if (!msg) {
+		talloc_free(link);
+		return RLM_MODULE_FAIL;
+	}
+
+	msg->worker = worker;
+	msg->link = link;
+	FR_DLIST_INIT(msg->entry);
+	mod_key_init(&msg->key, request);
+
+	msg->packet = talloc_memdup(msg, link->packet->data, link->packet->data_len);
+	if (!msg->packet) {
+	error:
+		talloc_free(msg);
+		talloc_free(link);
+		return RLM_MODULE_FAIL;
+	}
+	msg->packet_len = link->packet->data_len;
+
+	/*
+	 *	Give the I/O thread time to tell us that the home
+	 *	server didn't reply.
+	 */
+	gettimeofday(&when, NULL);
+	fr_timeval_add(&when, &when, &inst->response_timeout);
+	fr_timeval_add(&when, &when, &grace);
+
+	if (unlang_event_timeout_add(request, mod_shared_response_timeout, link, &when) < 0) goto error;
+
+	if (!fr_atomic_queue_push(worker->shared->aq, msg)) {
+		REDEBUG("Too many requests are waiting for the I/O thread");
+		(void) unlang_event_timeout_delete(request, link);
+		goto error;
+	}
+
+	link->msg = msg;
+	link->spool = true;
+	worker->outstanding++;
+	worker->submitted = true;
+
+	RDEBUG2("Proxying via the I/O thread");
+
+	return unlang_module_yield(request, mod_resume, mod_signal, link);
+}
+
+/** Close the socket to a collector
+ *
+ */
+static void mod_replica_close(rlm_radius_t const *inst, rlm_radius_replica_t *replica)
+{
+	if (replica->fd < 0) return;
+
+	inst->client_io->close(replica->fd, replica->client_io_ctx);
+	replica->fd = -1;
+}
+
+/** Open the socket to a collector, if it isn't already open
+ *
+ */
+static bool mod_replica_open(rlm_radius_t const *inst, rlm_radius_replica_t *replica, fr_time_t now)
+{
+	if (replica->fd >= 0) return true;
+
+	if (now < replica->next_open) return false;
+	replica->next_open = now + RLM_RADIUS_REPLICATE_REOPEN;
+
+	if (inst->client_io->init(&replica->fd, replica->client_io_ctx,
+				  replica->home_server->client_io_instance) == FR_CONNECTION_STATE_FAILED) {
+		PERROR("Failed opening socket to %s", replica->home_server->name);
+		replica->fd = -1;
+		return false;
+	}
+
+	/*
+	 *	Stream transports have to finish connecting before
+	 *	they can be used.
+	 */
+	if (inst->client_io->open) {
+		if ((fr_socket_wait_for_connect(replica->fd, &inst->connection_timeout) < 0) ||
+		    (inst->client_io->open(replica->fd, NULL, replica->client_io_ctx) != FR_CONNECTION_STATE_CONNECTED)) {
+			PERROR("Failed opening connection to %s", replica->home_server->name);
+			mod_replica_close(inst, replica);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/** Add tokens for the time which has passed, and say how many packets we can send
+ *
+ * Tokens are in nanoseconds of sending at max_rate, and a packet
+ * costs one second.  We allow bursts of a tenth of a second's worth
+ * of packets.
+ */
+static uint64_t mod_tokens_update(uint64_t *tokens, uint32_t max_rate, fr_time_t elapsed)
+{
+	uint64_t max;
+
+	if (!max_rate) return UINT64_MAX;
+
+	max = ((max_rate / 10) + 1) * (uint64_t) NANOSEC;
+
+	if (elapsed > NANOSEC) elapsed = NANOSEC;
+
+	*tokens += elapsed * max_rate;
+	if (*tokens > max) *tokens = max;
+
+	return *tokens / NANOSEC;
+}
+
+/** Send as many queued packets to a collector as max_rate allows
+ *
+ */
+static void mod_replica_send(rlm_radius_t const *inst, rlm_radius_replica_t *replica,
+			     fr_time_t now, fr_time_t elapsed)
+{
+	rlm_radius_replica_packet_t	*packet;
+	uint64_t			budget;
+	ssize_t				rcode;
+	int				i;
+	uint8_t				buffer[MAX_PACKET_LEN];
+
+	budget = mod_tokens_update(&replica->tokens, inst->replicate_max_rate, elapsed);
+
+	/*
+	 *	If the collector is down, packets stay in the queue
+	 *	until the workers push them out.
+	 */
+	if (!mod_replica_open(inst, replica, now)) return;
+
+	/*
+	 *	Replies are thrown away.  Reading them also keeps
+	 *	stream transports going, e.g. through a TLS handshake.
+	 */
+	for (i = 0; i < RLM_RADIUS_MAX_IDS; i++) {
+		rcode = inst->client_io->read(replica->fd, replica->client_io_ctx, buffer, sizeof(buffer));
+		if (rcode == 0) break;
+
+		if (rcode < 0) {
+			PERROR("Failed reading from %s", replica->home_server->name);
+			mod_replica_close(inst, replica);
+			return;
+		}
+	}
+
+	/*
+	 *	Don't add to data which a stream transport is still
+	 *	writing.
+	 */
+	if (inst->client_io->flush) {
+		int flushed;
+
+		flushed = inst->client_io->flush(replica->fd, replica->client_io_ctx);
+		if (flushed < 0) {
+			PERROR("Failed writing to %s", replica->home_server->name);
+			mod_replica_close(inst, replica);
+			return;
+		}
+
+		if (flushed > 0) return;
+	}
+
+	while (budget > 0) {
+		packet = replica->pending;
+		replica->pending = NULL;
+
+		if (!packet) {
+			if (!fr_atomic_queue_pop(replica->aq, (void **) &packet)) break;
+
+			packet->data[1] = replica->id++;
+			if (fr_radius_sign(packet->data, NULL, (uint8_t const *) inst->secret,
+					   inst->secret_len, NULL) < 0) {
+				PERROR("Failed signing packet for %s", replica->home_server->name);
+				replica->failed++;
+				free(packet);
+				continue;
+			}
+		}
+
+		rcode = inst->client_io->write(replica->fd, replica->client_io_ctx, packet->data, packet->data_len);
+		if (rcode == 0) {
+			replica->pending = packet;
+			break;
+		}
+
+		free(packet);
+
+		if (rcode < 0) {
+			PERROR("Failed writing to %s", replica->home_server->name);
+			replica->failed++;
+			mod_replica_close(inst, replica);
+			break;
+		}
+
+		replica->sent++;
+		budget--;
+		if (inst->replicate_max_rate) replica->tokens -= NANOSEC;
+	}
+}
+
+static void mod_replicate_timer(fr_event_list_t *el, struct timeval *now, void *uctx);
+
+/** Run the replication timer again, after RLM_RADIUS_REPLICATE_INTERVAL
+ *
+ */
+static int mod_replicate_timer_insert(rlm_radius_replicate_t *replicate)
+{
+	struct timeval	when, interval = { 0, RLM_RADIUS_REPLICATE_INTERVAL / 1000 };
+
+	gettimeofday(&when, NULL);
+	fr_timeval_add(&when, &when, &interval);
+
+	return fr_event_timer_insert(replicate->el, replicate->el, &replicate->ev, &when,
+				     mod_replicate_timer, replicate);
+}
+
+/** Send packets to the collectors
+ *
+ */
+static void mod_replicate_timer(fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	rlm_radius_replicate_t	*replicate = uctx;
+	rlm_radius_t const	*inst = replicate->inst;
+	fr_time_t		now_ns = fr_time();
+	fr_time_t		elapsed = now_ns - replicate->last;
+	uint32_t		i;
+
+	if (atomic_load(&replicate->exiting)) {
+		fr_event_loop_exit(el, 1);
+		return;
+	}
+
+	replicate->last = now_ns;
+
+	for (i = 0; i < inst->num_home_servers; i++) {
+		mod_replica_send(inst, &replicate->replica[i], now_ns, elapsed);
+	}
+
+	/*
+	 *	Complain about dropped packets at most once a second.
+	 */
+	if ((now_ns - replicate->last_report) >= NANOSEC) {
+		replicate->last_report = now_ns;
+
+		for (i = 0; i < inst->num_home_servers; i++) {
+			rlm_radius_replica_t	*replica = &replicate->replica[i];
+			uint64_t		dropped = atomic_load(&replica->dropped);
+
+			if (dropped == replica->reported) continue;
+
+			WARN("%s - Dropped %" PRIu64 " packets for %s, as its queue is full",
+			     inst->name, dropped - replica->reported, replica->home_server->name);
+			replica->reported = dropped;
+		}
+	}
+
+	if (mod_replicate_timer_insert(replicate) < 0) {
+		PERROR("Failed inserting replication timer");
+		fr_event_loop_exit(el, 1);
+	}
+}
+
+/** Run the event loop for replication
+ *
+ */
+static void *mod_replicate_thread(void *arg)
+{
+	rlm_radius_replicate_t	*replicate = arg;
+
+	DEBUG2("Started replication thread for %s", replicate->inst->name);
+
+	(void) fr_event_loop(replicate->el);
+
+	return NULL;
+}
+
+/** Queue a copy of the request for every collector
+ *
+ * We don't wait for the packets to be sent.  If a collector is slow,
+ * its oldest packets are thrown away.
+ */
+static rlm_rcode_t mod_replicate_process(rlm_radius_t const *inst, REQUEST *request)
+{
+	rlm_radius_replicate_t	*replicate = inst->replicate;
+	ssize_t			packet_len;
+	uint8_t			buffer[MAX_PACKET_LEN];
+	uint32_t		i;
+
+	/*
+	 *	The replication thread gives each copy its ID, and
+	 *	signs it.
+	 */
+	packet_len = mod_encode_copy(inst, request, buffer, sizeof(buffer));
+	if (packet_len < 0) {
+		RPEDEBUG("Failed encoding packet");
+		return RLM_MODULE_FAIL;
+	}
+
+	for (i = 0; i < inst->num_home_servers; i++) {
+		rlm_radius_replica_t		*replica = &replicate->replica[i];
+		rlm_radius_replica_packet_t	*copy, *old;
+
+		copy = malloc(sizeof(*copy) + packet_len);
+		if (!copy) {
+			REDEBUG("Out of memory");
+			return RLM_MODULE_FAIL;
+		}
+
+		copy->data_len = packet_len;
+		memcpy(copy->data, buffer, packet_len);
+
+		/*
+		 *	Make room by throwing away the oldest packet.
+		 *	Recent accounting data is worth more.
+		 */
+		while (!fr_atomic_queue_push(replica->aq, copy)) {
+			if (!fr_atomic_queue_pop(replica->aq, (void **) &old)) continue;
+
+			free(old);
+			atomic_fetch_add(&replica->dropped, 1);
+		}
+		atomic_fetch_add(&replica->queued, 1);
+
+		RDEBUG2("Replicating to %s", replica->home_server->name);
+	}
+
+	return RLM_MODULE_OK;
+}
+
+/** Close the socket we replay spooled packets on
+ *
+ * Packets which weren't answered are sent again on the next socket.
+ */
+static void mod_replay_close(rlm_radius_replay_t *replay)
+{
+	rlm_radius_t const	*inst = replay->inst;
+	uint32_t		i;
+
+	if (replay->fd < 0) return;
+
+	inst->client_io->close(replay->fd, replay->client_io_ctx);
+	replay->fd = -1;
+	replay->unanswered = 0;
+
+	for (i = 0; i < replay->num; i++) {
+		replay->slot[(replay->head + i) % inst->spool_window].sent = 0;
+	}
+}
+
+/** Open a socket to the current home server, if it isn't already open
+ *
+ * If we can't, we move on to the next home server.
+ */
+static bool mod_replay_open(rlm_radius_replay_t *replay, fr_time_t now)
+{
+	rlm_radius_t const		*inst = replay->inst;
+	rlm_radius_home_server_t const	*home_server = &inst->home_servers[replay->home];
+
+	if (replay->fd >= 0) return true;
+
+	if (now < replay->next_open) return false;
+	replay->next_open = now + (inst->reconnection_delay.tv_sec * (fr_time_t) NANOSEC) +
+			    (inst->reconnection_delay.tv_usec * (fr_time_t) 1000);
+
+	if (inst->client_io->init(&replay->fd, replay->client_io_ctx,
+				  home_server->client_io_instance) == FR_CONNECTION_STATE_FAILED) {
+		PERROR("Failed opening socket to %s", home_server->name);
+		replay->fd = -1;
+		goto next;
+	}
+
+	if (inst->client_io->open) {
+		if ((fr_socket_wait_for_connect(replay->fd, &inst->connection_timeout) < 0) ||
+		    (inst->client_io->open(replay->fd, NULL, replay->client_io_ctx) != FR_CONNECTION_STATE_CONNECTED)) {
+			PERROR("Failed opening connection to %s", home_server->name);
+			mod_replay_close(replay);
+		next:
+			replay->home = (replay->home + 1) % inst->num_home_servers;
+			return false;
+		}
+	}
+
+	DEBUG2("%s - Replaying spooled packets to %s", inst->name, home_server->name);
+
+	return true;
+}
+
+/** Read replies to the packets we've replayed
+ *
+ */
+static void mod_replay_read(rlm_radius_replay_t *replay)
+{
+	rlm_radius_t const		*inst = replay->inst;
+	rlm_radius_replay_slot_t	*slot;
+	decode_fail_t			reason;
+	ssize_t				rcode;
+	size_t				data_len;
+	int				i;
+	uint8_t				buffer[MAX_PACKET_LEN];
+
+	for (i = 0; i < RLM_RADIUS_MAX_IDS; i++) {
+		rcode = inst->client_io->read(replay->fd, replay->client_io_ctx, buffer, sizeof(buffer));
+		if (rcode == 0) break;
+
+		if (rcode < 0) {
+			PERROR("Failed reading from %s", inst->home_servers[replay->home].name);
+			mod_replay_close(replay);
+			return;
+		}
+
+		data_len = rcode;
+		if (!fr_radius_ok(buffer, &data_len, false, &reason)) continue;
+
+		/*
+		 *	The ID is the packet's slot.  Replies to packets
+		 *	we've already forgotten about won't verify.
+		 */
+		if ((buffer[0] != FR_CODE_ACCOUNTING_RESPONSE) || (buffer[1] >= inst->spool_window)) continue;
+
+		slot = &replay->slot[buffer[1]];
+		if (((buffer[1] + inst->spool_window - replay->head) % inst->spool_window) >= replay->num) continue;
+		if (!slot->sent || slot->acked) continue;
+
+		if (fr_radius_verify(buffer, slot->data,
+				     (uint8_t const *) inst->secret, inst->secret_len, NULL) < 0) continue;
+
+		slot->acked = true;
+		replay->unanswered = 0;
+	}
+}
+
+/** Add the time a packet spent in the spool to its Acct-Delay-Time
+ *
+ * If it doesn't have one, and there's room, we add one.
+ */
+static void mod_replay_delay(uint8_t *data, size_t *data_len, uint32_t delay)
+{
+	uint8_t		*attr, *end = data + *data_len;
+	uint32_t	value;
+
+	for (attr = data + RADIUS_HDR_LEN; (attr + 2) <= end; attr += attr[1]) {
+		if (attr[1] < 2) return;
+
+		if ((attr[0] != FR_ACCT_DELAY_TIME) || (attr[1] != 6)) continue;
+
+		memcpy(&value, attr + 2, sizeof(value));
+		value = htonl(ntohl(value) + delay);
+		memcpy(attr + 2, &value, sizeof(value));
+		return;
+	}
+
+	if ((*data_len + 6) > MAX_PACKET_LEN) return;
+
+	attr = data + *data_len;
+	attr[0] = FR_ACCT_DELAY_TIME;
+	attr[1] = 6;
+	value = htonl(delay);
+	memcpy(attr + 2, &value, sizeof(value));
+
+	*data_len += 6;
+	data[2] = (*data_len >> 8) & 0xff;
+	data[3] = *data_len & 0xff;
+}
+
+/** Read packets from the spool, as long as there are free IDs
+ *
+ */
+static void mod_replay_fill(rlm_radius_replay_t *replay, uint64_t budget)
+{
+	rlm_radius_t const		*inst = replay->inst;
+	rlm_radius_replay_slot_t	*slot;
+	uint8_t const			*packet;
+	size_t				packet_len;
+	time_t				when, now = time(NULL);
+	uint32_t			id;
+
+	while ((budget > 0) && (replay->num < inst->spool_window)) {
+		if (!radius_spool_read(inst->spool, &replay->read, &packet, &packet_len, &when)) break;
+
+		id = (replay->head + replay->num) % inst->spool_window;
+		slot = &replay->slot[id];
+
+		memcpy(slot->data, packet, packet_len);
+		slot->data_len = packet_len;
+		slot->next = replay->read;
+		slot->sent = 0;
+		slot->acked = false;
+
+		replay->num++;
+		budget--;
+		if (inst->spool_max_rate) replay->tokens -= NANOSEC;
+
+		if (now > when) mod_replay_delay(slot->data, &slot->data_len, now - when);
+
+		slot->data[1] = id;
+		if (fr_radius_sign(slot->data, NULL, (uint8_t const *) inst->secret,
+				   inst->secret_len, NULL) < 0) {
+			PERROR("Failed signing spooled packet.  Discarding it");
+			slot->acked = true;
+		}
+	}
+}
+
+/** Remove the packets at the start of the window which have been answered
+ *
+ */
+static void mod_replay_advance(rlm_radius_replay_t *replay)
+{
+	rlm_radius_t const		*inst = replay->inst;
+	rlm_radius_replay_slot_t	*slot = NULL;
+
+	while (replay->num && replay->slot[replay->head].acked) {
+		slot = &replay->slot[replay->head];
+
+		replay->head = (replay->head + 1) % inst->spool_window;
+		replay->num--;
+		atomic_fetch_add(&replay->replayed, 1);
+	}
+
+	if (slot) radius_spool_ack(inst->spool, &slot->next);
+}
+
+/** Send the packets which haven't been sent, or which weren't answered in time
+ *
+ */
+static void mod_replay_send(rlm_radius_replay_t *replay, fr_time_t now)
+{
+	rlm_radius_t const		*inst = replay->inst;
+	rlm_radius_replay_slot_t	*slot;
+	fr_time_t			timeout;
+	ssize_t				rcode;
+	uint32_t			i;
+
+	timeout = (inst->response_timeout.tv_sec * (fr_time_t) NANOSEC) +
+		  (inst->response_timeout.tv_usec * (fr_time_t) 1000);
+
+	for (i = 0; i < replay->num; i++) {
+		slot = &replay->slot[(replay->head + i) % inst->spool_window];
+		if (slot->acked) continue;
+
+		if (slot->sent) {
+			if ((now - slot->sent) < timeout) continue;
+
+			/*
+			 *	Try the next home server, after a while.
+			 */
+			if (++replay->unanswered >= inst->max_unanswered) {
+				WARN("%s - No replies to spooled packets from %s", inst->name,
+				     inst->home_servers[replay->home].name);
+				mod_replay_close(replay);
+				replay->home = (replay->home + 1) % inst->num_home_servers;
+				return;
+			}
+		}
+
+		rcode = inst->client_io->write(replay->fd, replay->client_io_ctx, slot->data, slot->data_len);
+		if (rcode == 0) return;
+
+		if (rcode < 0) {
+			PERROR("Failed writing to %s", inst->home_servers[replay->home].name);
+			mod_replay_close(replay);
+			return;
+		}
+
+		slot->sent = now;
+	}
+}
+
+static void mod_replay_timer(fr_event_list_t *el, struct timeval *now, void *uctx);
+
+/** Run the replay timer again, after RLM_RADIUS_REPLICATE_INTERVAL
+ *
+ */
+static int mod_replay_timer_insert(rlm_radius_replay_t *replay)
+{
+	struct timeval	when, interval = { 0, RLM_RADIUS_REPLICATE_INTERVAL / 1000 };
+
+	gettimeofday(&when, NULL);
+	fr_timeval_add(&when, &when, &interval);
+
+	return fr_event_timer_insert(replay->el, replay->el, &replay->ev, &when,
+				     mod_replay_timer, replay);
+}
+
+/** Replay spooled packets
+ *
+ */
+static void mod_replay_timer(fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	rlm_radius_replay_t	*replay = uctx;
+	rlm_radius_t const	*inst = replay->inst;
+	fr_time_t		now_ns = fr_time();
+	fr_time_t		elapsed = now_ns - replay->last;
+	uint64_t		budget;
+
+	if (atomic_load(&replay->exiting)) {
+		fr_event_loop_exit(el, 1);
+		return;
+	}
+
+	replay->last = now_ns;
+
+	if (replay->fd >= 0) mod_replay_read(replay);
+	mod_replay_advance(replay);
+
+	budget = mod_tokens_update(&replay->tokens, inst->spool_max_rate, elapsed);
+	mod_replay_fill(replay, budget);
+
+	if (!replay->num || !mod_replay_open(replay, now_ns)) goto again;
+
+	/*
+	 *	Don't add to data which a stream transport is still
+	 *	writing.
+	 */
+	if (inst->client_io->flush) {
+		int flushed;
+
+		flushed = inst->client_io->flush(replay->fd, replay->client_io_ctx);
+		if (flushed < 0) {
+			PERROR("Failed writing to %s", inst->home_servers[replay->home].name);
+			mod_replay_close(replay);
+			goto again;
+		}
+
+		if (flushed > 0) goto again;
+	}
+
+	mod_replay_send(replay, now_ns);
+
+again:
+	if (mod_replay_timer_insert(replay) < 0) {
+		PERROR("Failed inserting replay timer");
+		fr_event_loop_exit(el, 1);
+	}
+}
+
+/** Run the event loop for replaying the spool
+ *
+ */
+static void *mod_replay_thread(void *arg)
+{
+	rlm_radius_replay_t	*replay = arg;
+
+	DEBUG2("Started spool replay thread for %s", replay->inst->name);
+
+	(void) fr_event_loop(replay->el);
+
+	return NULL;
+}
+
+/** Return statistics about the spool
+ *
+@verbatim
+%{<inst>_spool:<counter>}
+@endverbatim
+ *
+ * The counters are records, bytes, age (of the oldest packet, in
+ * seconds), and replayed.
+ */
+static ssize_t spool_stats_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
+				void const *mod_inst, UNUSED void const *xlat_inst,
+				REQUEST *request, char const *fmt)
+{
+	rlm_radius_t const	*inst = mod_inst;
+	radius_spool_stats_t	stats;
+	uint64_t		value;
+	time_t			now;
+
+	if (!inst->spool) {
+		REDEBUG("No spool is configured");
+		return -1;
+	}
+
+	radius_spool_stats(inst->spool, &stats);
+
+	while (isspace((int) *fmt)) fmt++;
+
+	if (strcmp(fmt, "records") == 0) {
+		value = stats.records;
+	} else if (strcmp(fmt, "bytes") == 0) {
+		value = stats.bytes;
+	} else if (strcmp(fmt, "age") == 0) {
+		now = time(NULL);
+		value = (stats.oldest && (now > stats.oldest)) ? (uint64_t) (now - stats.oldest) : 0;
+	} else if (strcmp(fmt, "replayed") == 0) {
+		value = inst->replay ? atomic_load(&inst->replay->replayed) : 0;
+	} else {
+		REDEBUG("Unknown spool statistic \"%s\"", fmt);
+		return -1;
+	}
+
+	*out = talloc_typed_asprintf(ctx, "%" PRIu64, value);
+	return talloc_array_length(*out) - 1;
+}
+
+/** The original request didn't finish in time
+ *
+ */
+static void mod_follower_timeout(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+				 UNUSED struct timeval *fired)
+{
+	rlm_radius_link_t	*link = talloc_get_type_abort(ctx, rlm_radius_link_t);
+
+	REDEBUG("No reply to the original request");
+
+	(void) mod_link_finish(link);
+	link->rcode = RLM_MODULE_FAIL;
+	unlang_resumable(request);
+}
+
+/** Wait for the reply to the original request, instead of proxying a retransmission
+ *
+ */
+static rlm_rcode_t mod_follow(rlm_radius_t const *inst, rlm_radius_link_t *leader, REQUEST *request)
+{
+	rlm_radius_link_t	*link;
+	struct timeval		when;
+
+	link = mod_link_alloc(inst, request, request);
+	if (!link) return RLM_MODULE_FAIL;
+
+	gettimeofday(&when, NULL);
+	fr_timeval_add(&when, &when, &inst->response_timeout);
+
+	if (unlang_event_timeout_add(request, mod_follower_timeout, link, &when) < 0) {
+		talloc_free(link);
+		return RLM_MODULE_FAIL;
+	}
+
+	RDEBUG2("Request is a retransmission, waiting for the reply to the original");
+
+	fr_dlist_insert_tail(&leader->followers, &link->entry);
+
+	return unlang_module_yield(request, mod_resume, mod_signal, link);
+}
+
+/** Send packets outbound.
+ *
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_process(void *instance, void *thread, REQUEST *request)
+{
+	rlm_radius_t *inst = instance;
+	rlm_radius_thread_t *t = talloc_get_type_abort(thread, rlm_radius_thread_t);
+	rlm_radius_home_t *home;
+	rlm_radius_link_t *link, *hedge;
+	rlm_radius_key_t key;
+	struct timeval when, delay;
+
+	if (inst->replicate) return mod_replicate_process(inst, request);
+
+	if (inst->shared) return mod_shared_process(inst, t, request);
+
+	/*
+	 *	The NAS retransmitted a request which we're already
+	 *	proxying.  Don't send the home server another copy.
+	 */
+	mod_key_init(&key, request);
+	link = mod_inflight_find(t, &key);
+	if (link) return mod_follow(inst, link, request);
+
+	home = mod_home_select(t);
+
+	link = mod_link_alloc(inst, request, request);
+	if (!link) return RLM_MODULE_FAIL;
+
+	link->key = key;
+	link->spool = true;
+
+	gettimeofday(&when, NULL);
+	fr_timeval_add(&when, &when, &inst->response_timeout);
+
+	if (unlang_event_timeout_add(request, mod_response_timeout, link, &when) < 0) {
+		talloc_free(link);
+		return RLM_MODULE_FAIL;
+	}
+
+	mod_link_send(home, link);
+	mod_inflight_insert(t, link);
+
+	if ((inst->hedge_mode == RLM_RADIUS_HEDGE_NONE) || (inst->num_home_servers < 2)) goto yield;
+
+	/*
+	 *	Every request adds to the budget for hedging.
+	 */
+	t->hedge_budget += inst->hedge_max_load;
+	if (t->hedge_budget > (100 * RLM_RADIUS_HEDGE_BURST)) t->hedge_budget = 100 * RLM_RADIUS_HEDGE_BURST;
+
+	/*
+	 *	We don't know yet how quickly the home server replies.
+	 */
+	if ((inst->hedge_mode == RLM_RADIUS_HEDGE_DELAYED) && !home->hedge_delay) goto yield;
+
+	/*
+	 *	The hedged copy is freed along with the first one.
+	 */
+	hedge = mod_link_alloc(inst, link, request);
+	if (!hedge) goto yield;
+
+	hedge->primary = link;
+	link->hedge = hedge;
+
+	if (inst->hedge_mode == RLM_RADIUS_HEDGE_IMMEDIATE) {
+		mod_hedge_send(t, hedge);
+		goto yield;
+	}
+
+	delay.tv_sec = home->hedge_delay / NANOSEC;
+	delay.tv_usec = (home->hedge_delay % NANOSEC) / 1000;
+
+	gettimeofday(&when, NULL);
+	fr_timeval_add(&when, &when, &delay);
+
+	if (unlang_event_timeout_add(request, mod_hedge_timeout, hedge, &when) < 0) {
+		link->hedge = NULL;
+		talloc_free(hedge);
+	}
+
+yield:
+	return unlang_module_yield(request, mod_resume, mod_signal, link);
+}
+
+
+/** Bootstrap the module
+ *
+ * Bootstrap I/O and type submodules.
+ *
+ * @param[in] instance	Ctx data for this module
+ * @param[in] conf    our configuration section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_bootstrap(void *instance, CONF_SECTION *conf)
+{
+	rlm_radius_t *inst = talloc_get_type_abort(instance, rlm_radius_t);
+	uint32_t i;
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	inst->secret_len = talloc_array_length(inst->secret) - 1;
+
+	FR_TIMEVAL_BOUND_CHECK("timers.connection", &inst->connection_timeout, >=, 1, 0);
+	FR_TIMEVAL_BOUND_CHECK("timers.connection", &inst->connection_timeout, <=, 30, 0);
+
+	FR_TIMEVAL_BOUND_CHECK("timers.reconnect", &inst->reconnection_delay, >=, 5, 0);
+	FR_TIMEVAL_BOUND_CHECK("timers.reconnect", &inst->reconnection_delay, <=, 300, 0);
+
+	FR_TIMEVAL_BOUND_CHECK("timers.idle", &inst->idle_timeout, >=, 30, 0);
+	FR_TIMEVAL_BOUND_CHECK("timers.idle", &inst->idle_timeout, <=, 600, 0);
+
+	FR_TIMEVAL_BOUND_CHECK("timers.response", &inst->response_timeout, >=, 1, 0);
+	FR_TIMEVAL_BOUND_CHECK("timers.response", &inst->response_timeout, <=, 60, 0);
+
+	FR_INTEGER_BOUND_CHECK("connections.min", inst->min_connections, >=, 1);
+	FR_INTEGER_BOUND_CHECK("connections.max", inst->max_connections, >=, inst->min_connections);
+	FR_INTEGER_BOUND_CHECK("connections.max", inst->max_connections, <=, 1024);
+	FR_INTEGER_BOUND_CHECK("connections.spare_ids", inst->spare_ids, <=, RLM_RADIUS_MAX_IDS);
+
+	FR_TIMEVAL_BOUND_CHECK("zombie.period", &inst->zombie_period, >=, 1, 0);
+	FR_TIMEVAL_BOUND_CHECK("zombie.period", &inst->zombie_period, <=, 120, 0);
+
+	FR_INTEGER_BOUND_CHECK("zombie.unanswered", inst->max_unanswered, >=, 1);
+	FR_INTEGER_BOUND_CHECK("zombie.unanswered", inst->max_unanswered, <=, 1000);
+
+	FR_TIMEVAL_BOUND_CHECK("zombie.check_interval", &inst->check_interval, >=, 0, 100000);
+	FR_TIMEVAL_BOUND_CHECK("zombie.check_interval", &inst->check_interval, <=, 60, 0);
+
+	FR_TIMEVAL_BOUND_CHECK("zombie.max_check_interval", &inst->max_check_interval, >=,
+			       inst->check_interval.tv_sec, inst->check_interval.tv_usec);
+	FR_TIMEVAL_BOUND_CHECK("zombie.max_check_interval", &inst->max_check_interval, <=, 600, 0);
+
+	FR_INTEGER_BOUND_CHECK("zombie.num_answers_to_alive", inst->num_answers_to_alive, >=, 1);
+	FR_INTEGER_BOUND_CHECK("zombie.num_answers_to_alive", inst->num_answers_to_alive, <=, 10);
+
+	inst->zombie_period_time = (inst->zombie_period.tv_sec * (fr_time_t) NANOSEC) +
+				   (inst->zombie_period.tv_usec * (fr_time_t) 1000);
+
+	inst->mode = fr_str2int(mode_table, inst->mode_str, RLM_RADIUS_MODE_INVALID);
+	if (inst->mode == RLM_RADIUS_MODE_INVALID) {
+		cf_log_err(conf, "Invalid mode \"%s\"", inst->mode_str);
+		return -1;
+	}
+
+	FR_INTEGER_BOUND_CHECK("replicate.queue_size", inst->replicate_queue_size, >=, 16);
+	FR_INTEGER_BOUND_CHECK("replicate.queue_size", inst->replicate_queue_size, <=, 1048576);
+	FR_INTEGER_BOUND_CHECK("replicate.max_rate", inst->replicate_max_rate, <=, 1000000);
+
+	/*
+	 *	Replication doesn't use the connections.
+	 */
+	if (inst->mode == RLM_RADIUS_MODE_REPLICATE) inst->shared_connections = false;
+
+	if (inst->spool_directory && (inst->mode != RLM_RADIUS_MODE_PROXY)) {
+		cf_log_warn(conf, "The spool is only used with \"mode = proxy\".  Ignoring it");
+		inst->spool_directory = NULL;
+	}
+
+	if (inst->spool_directory) {
+		char buffer[256];
+
+		FR_SIZE_BOUND_CHECK("spool.segment_size", inst->spool_segment_size, >=, (size_t) 65536);
+		FR_SIZE_BOUND_CHECK("spool.max_size", inst->spool_max_size, >=, inst->spool_segment_size);
+		FR_INTEGER_BOUND_CHECK("spool.max_rate", inst->spool_max_rate, <=, 1000000);
+		FR_INTEGER_BOUND_CHECK("spool.window", inst->spool_window, >=, 1);
+		FR_INTEGER_BOUND_CHECK("spool.window", inst->spool_window, <=, RLM_RADIUS_MAX_IDS);
+
+		snprintf(buffer, sizeof(buffer), "%s_spool", inst->name);
+		xlat_register(inst, buffer, spool_stats_xlat, NULL, NULL, 0, 0);
+	}
+
+	inst->hedge_mode = fr_str2int(hedge_mode_table, inst->hedge_mode_str, RLM_RADIUS_HEDGE_INVALID);
+	if (inst->hedge_mode == RLM_RADIUS_HEDGE_INVALID) {
+		cf_log_err(conf, "Invalid hedge mode \"%s\"", inst->hedge_mode_str);
+		return -1;
+	}
+
+	FR_INTEGER_BOUND_CHECK("hedge.percentile", inst->hedge_percentile, >=, 50);
+	FR_INTEGER_BOUND_CHECK("hedge.percentile", inst->hedge_percentile, <=, 99);
+
+	FR_INTEGER_BOUND_CHECK("hedge.max_load", inst->hedge_max_load, <=, 100);
+
+	/*
+	 *	The I/O thread has no requests to hang the hedge
+	 *	timers off of.
+	 */
+	if (inst->shared_connections && (inst->hedge_mode != RLM_RADIUS_HEDGE_NONE)) {
+		cf_log_warn(conf, "Hedging is not supported with shared connections.  Disabling it");
+		inst->hedge_mode = RLM_RADIUS_HEDGE_NONE;
+	}
+
+	inst->num_home_servers = talloc_array_length(inst->io_submodule);
+	rad_assert(inst->num_home_servers > 0);
+
+	inst->client_io = (fr_radius_client_io_t *) inst->io_submodule[0]->module->common;
+
+	rad_assert(inst->client_io->io_inst_size > 0);
+
+	MEM(inst->home_servers = talloc_zero_array(inst, rlm_radius_home_server_t, inst->num_home_servers));
+
+	for (i = 0; i < inst->num_home_servers; i++) {
+		rlm_radius_home_server_t *home_server = &inst->home_servers[i];
+
+		home_server->client_io_instance = inst->io_submodule[i]->data;
+		home_server->client_io_conf = inst->io_submodule[i]->conf;
+
+		home_server->name = cf_section_name2(home_server->client_io_conf);
+		if (!home_server->name) home_server->name = cf_section_name1(home_server->client_io_conf);
+
+		if (!inst->client_io->bootstrap) continue;
+
+		if (inst->client_io->bootstrap(home_server->client_io_instance, home_server->client_io_conf) < 0) {
+			cf_log_err(home_server->client_io_conf, "Bootstrap failed for \"%s\"",
+				   inst->client_io->name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/** Free the data for the I/O thread
+ *
+ */
+static int mod_shared_free(rlm_radius_shared_t *shared)
+{
+	pthread_mutex_destroy(&shared->mutex);
+
+	return 0;
+}
+
+/** Free the data for the replication thread
+ *
+ */
+static int mod_replicate_free(rlm_radius_replicate_t *replicate)
+{
+	pthread_mutex_destroy(&replicate->mutex);
+
+	return 0;
+}
+
+/** Free the data for the replay thread
+ *
+ */
+static int mod_replay_free(rlm_radius_replay_t *replay)
+{
+	pthread_mutex_destroy(&replay->mutex);
+
+	return 0;
+}
+
+/** Instantiate the module
+ *
+ * Instantiate I/O and type submodules.
+ *
+ * @param[in] instance	Ctx data for this module
+ * @param[in] conf	our configuration section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_radius_t *inst = talloc_get_type_abort(instance, rlm_radius_t);
+	uint32_t i;
+
+	/*
+	 *	The I/O thread is started by the first worker.
+	 */
+	if (inst->shared_connections) {
+		inst->shared = talloc_zero(inst, rlm_radius_shared_t);
+		if (!inst->shared) return -1;
+
+		pthread_mutex_init(&inst->shared->mutex, NULL);
+		FR_DLIST_INIT(inst->shared->workers);
+		FR_DLIST_INIT(inst->shared->returning);
+		talloc_set_destructor(inst->shared, mod_shared_free);
+	}
+
+	if (inst->mode == RLM_RADIUS_MODE_REPLICATE) {
+		rlm_radius_replicate_t *replicate;
+
+		replicate = inst->replicate = talloc_zero(inst, rlm_radius_replicate_t);
+		if (!replicate) return -1;
+
+		pthread_mutex_init(&replicate->mutex, NULL);
+		talloc_set_destructor(replicate, mod_replicate_free);
+
+		replicate->inst = inst;
+		replicate->replica = talloc_zero_array(replicate, rlm_radius_replica_t, inst->num_home_servers);
+		if (!replicate->replica) return -1;
+
+		for (i = 0; i < inst->num_home_servers; i++) {
+			rlm_radius_replica_t *replica = &replicate->replica[i];
+
+			replica->home_server = &inst->home_servers[i];
+			replica->fd = -1;
+
+			replica->aq = fr_atomic_queue_create(replicate, inst->replicate_queue_size);
+			replica->client_io_ctx = talloc_zero_array(replicate, uint8_t, inst->client_io->io_inst_size);
+			if (!replica->aq || !replica->client_io_ctx) return -1;
+		}
+	}
+
+	/*
+	 *	The replay thread is started by the first worker.
+	 */
+	if (inst->spool_directory) {
+		rlm_radius_replay_t *replay;
+
+		inst->spool = radius_spool_open(inst, inst->spool_directory, inst->spool_segment_size,
+						inst->spool_max_size, inst->spool_sync);
+		if (!inst->spool) {
+			cf_log_perr(conf, "Failed opening spool");
+			return -1;
+		}
+
+		replay = inst->replay = talloc_zero(inst, rlm_radius_replay_t);
+		if (!replay) return -1;
+
+		pthread_mutex_init(&replay->mutex, NULL);
+		talloc_set_destructor(replay, mod_replay_free);
+
+		replay->inst = inst;
+		replay->fd = -1;
+		replay->slot = talloc_zero_array(replay, rlm_radius_replay_slot_t, inst->spool_window);
+		replay->client_io_ctx = talloc_zero_array(replay, uint8_t, inst->client_io->io_inst_size);
+		if (!replay->slot || !replay->client_io_ctx) return -1;
+	}
+
+	if (!inst->client_io->instantiate) return 0;
+
+	for (i = 0; i < inst->num_home_servers; i++) {
+		rlm_radius_home_server_t *home_server = &inst->home_servers[i];
+
+		if (inst->client_io->instantiate(home_server->client_io_instance, home_server->client_io_conf) < 0) {
+			cf_log_err(home_server->client_io_conf, "Instantiate failed for \"%s\"",
+				   inst->client_io->name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Close all of the connections to a home server
+ *
+ */
+static void mod_home_detach(rlm_radius_home_t *home)
+{
+	fr_dlist_t *entry, *next;
+
+	/*
+	 *	Free up all of the connections.
+	 */
+	for (entry = FR_DLIST_FIRST(home->frozen);
+	     entry != NULL;
+	     entry = next) {
+		rlm_radius_connection_t *c;
+
+		c = fr_ptr_to_type(rlm_radius_connection_t, entry, entry);
+
+		next = FR_DLIST_NEXT(home->frozen, entry);
+		talloc_free(c);
+	}
+
+	for (entry = FR_DLIST_FIRST(home->active);
+	     entry != NULL;
+	     entry = next) {
+		rlm_radius_connection_t *c;
+
+		c = fr_ptr_to_type(rlm_radius_connection_t, entry, entry);
+
+		next = FR_DLIST_NEXT(home->active, entry);
+		talloc_free(c);
+	}
+
+	for (entry = FR_DLIST_FIRST(home->closed);
+	     entry != NULL;
+	     entry = next) {
+		rlm_radius_connection_t *c;
+
+		c = fr_ptr_to_type(rlm_radius_connection_t, entry, entry);
+
+		next = FR_DLIST_NEXT(home->closed, entry);
+		talloc_free(c);
+	}
 
 	/*
-	 *	Remove us from whatever list we're in.
+	 *	Now that all of the connections are closed, all of the
+	 *	requests we manage should be in home->queued.  The link
+	 *	is freed when the request resumes.
 	 */
-	fr_dlist_remove(&c->entry);
-
-	 /*
-	  *	Move any requests from the connection "sent" back to the
-	  *	thread "queued" list.
-	  */
-	for (entry = FR_DLIST_FIRST(c->sent);
+	for (entry = FR_DLIST_FIRST(home->queued);
 	     entry != NULL;
 	     entry = next) {
 		rlm_radius_link_t *link;
 
 		link = fr_ptr_to_type(rlm_radius_link_t, entry, entry);
 
-		next = FR_DLIST_NEXT(c->sent, entry);
-
-		rad_assert(link->waiting = true);
-		link->waiting = false;
-		c->waiting--;
-
-		fr_dlist_remove(&link->entry);
-
-		// @todo - insert into the list by when we first sent
-		// the packet, so that earlier packets are handled
-		// before later packets
-		fr_dlist_insert_tail(&t->queued, &link->entry);
+		next = FR_DLIST_NEXT(home->queued, entry);
 
-		t->pending = true;
+		mod_link_fail(link);
 	}
+}
 
-	 /*
-	  *	Move any requests from the connection "queued" back to the
-	  *	thread "queued" list.
-	  */
-	for (entry = FR_DLIST_FIRST(c->queued);
-	     entry != NULL;
-	     entry = next) {
-		rlm_radius_link_t *link;
+/** Close all of a thread's connections
+ *
+ */
+static void mod_thread_free(rlm_radius_thread_t *t)
+{
+	uint32_t i;
 
-		link = fr_ptr_to_type(rlm_radius_link_t, entry, entry);
+	if (!t->home) return;
 
-		next = FR_DLIST_NEXT(c->queued, entry);
+	for (i = 0; i < t->inst->num_home_servers; i++) mod_home_detach(&t->home[i]);
+}
 
-		rad_assert(link->waiting = false);
+/** Set up the home servers for a thread, and open the connections
+ *
+ */
+static int mod_thread_init(CONF_SECTION const *cs, rlm_radius_t const *inst, rlm_radius_thread_t *t,
+			   fr_event_list_t *el)
+{
+	uint32_t i, j;
 
-		fr_dlist_remove(&link->entry);
+	t->inst = inst;
+	t->el = el;
 
-		// @todo - insert into the list by when we first sent
-		// the packet, so that earlier packets are handled
-		// before later packets
-		fr_dlist_insert_tail(&t->queued, &link->entry);
+	t->home = talloc_zero_array(t, rlm_radius_home_t, inst->num_home_servers);
+	if (!t->home) return -1;
 
-		t->pending = true;
+	t->inflight = fr_hash_table_create(t, mod_key_hash, mod_key_cmp, NULL);
+	if (!t->inflight) return -1;
+
+	/*
+	 *	Connections are only read from one at a time, so they
+	 *	can share a receive buffer.
+	 */
+	if (inst->client_io->read_batch) {
+		t->rx_buffer = talloc_array(t, uint8_t, RLM_RADIUS_BATCH_MAX * MAX_PACKET_LEN);
+		if (!t->rx_buffer) return -1;
 	}
 
-	if (t->pending) mod_clear_backlog(t);
+	for (i = 0; i < inst->num_home_servers; i++) {
+		rlm_radius_home_t *home = &t->home[i];
+
+		home->home_server = &inst->home_servers[i];
+		home->thread = t;
+
+		FR_DLIST_INIT(home->queued);
+		FR_DLIST_INIT(home->active);
+		FR_DLIST_INIT(home->frozen);
+		FR_DLIST_INIT(home->closed);
+
+		home->metrics = fr_metric_set_alloc(t->home, home_metrics, HOME_METRIC_MAX, false);
+		if (home->metrics &&
+		    ((fr_metric_set_label(home->metrics, "module", inst->name) < 0) ||
+		     (fr_metric_set_label(home->metrics, "home_server", home->home_server->name) < 0))) {
+			TALLOC_FREE(home->metrics);
+		}
+
+		/*
+		 *	Open the minimum number of connections.
+		 *	mod_process() will open more if necessary.
+		 */
+		for (j = 0; j < inst->min_connections; j++) {
+			if (mod_radius_conn_alloc(home) < 0) {
+				cf_log_err(cs, "Failed opening connection to %s", home->home_server->name);
+				return -1;
+			}
+		}
+	}
 
 	return 0;
 }
 
-/** Unlink a request from wherever it is
+/** Stop the I/O thread, and free everything it had
  *
+ * This is called by the last worker to detach.
  */
-static int mod_link_free(rlm_radius_link_t *link)
+static void mod_shared_stop(rlm_radius_shared_t *shared)
 {
-	fr_dlist_remove(&link->entry);
-	if (!link->waiting) return 0;
-
-	// remove it from the client IO
+	rlm_radius_shared_msg_t	*msg;
+	fr_dlist_t		*entry;
+
+	if (shared->running) {
+		atomic_store(&shared->exiting, true);
+		(void) fr_event_user_trigger(shared->kq, shared->ident);
+		(void) pthread_join(shared->pthread_id, NULL);
+		shared->running = false;
+	}
 
-//	inst->client_io->remove(request, c->client_io_ctx, link->request_io_ctx);
+	/*
+	 *	Closing the connections puts the requests on the
+	 *	returning list.  None of the workers want them.
+	 */
+	if (shared->thread) {
+		mod_thread_free(shared->thread);
+		TALLOC_FREE(shared->thread);
+	}
 
-	return 0;
-}
+	if (shared->aq) {
+		while (fr_atomic_queue_pop(shared->aq, (void **) &msg)) talloc_free(msg);
+		TALLOC_FREE(shared->aq);
+	}
 
+	while ((entry = FR_DLIST_FIRST(shared->returning)) != NULL) {
+		msg = fr_ptr_to_type(rlm_radius_shared_msg_t, entry, entry);
+		fr_dlist_remove(&msg->entry);
+		talloc_free(msg);
+	}
 
-static int CC_HINT(nonnull) mod_add(rlm_radius_t *inst, rlm_radius_connection_t *c, REQUEST *request)
-{
-	rlm_radius_link_t *link;
-	size_t size;
+	while ((entry = FR_DLIST_FIRST(shared->workers)) != NULL) {
+		rlm_radius_worker_t *worker;
 
-	/*
-	 *	The client IO module may need to store per-request
-	 *	data.  Add it here for simpliciy.
-	 */
-	size = sizeof(rlm_radius_link_t);
-	if (inst->client_io->request_inst_size) {
-		size += 15;
-		size &= ~((size_t) 15);
+		worker = fr_ptr_to_type(rlm_radius_worker_t, entry, entry);
+		fr_dlist_remove(&worker->entry);
 
-		size += inst->client_io->request_inst_size;
+		while (fr_atomic_queue_pop(worker->aq, (void **) &msg)) talloc_free(msg);
+		talloc_free(worker);
 	}
 
-	link = (rlm_radius_link_t *) talloc_zero_array(c, uint64_t, (size / sizeof(uint64_t)));
-	talloc_set_type(link, rlm_radius_link_t);
-	rad_assert(link != NULL);
+	TALLOC_FREE(shared->el);
+}
 
-	if (size > sizeof(rlm_radius_link_t)) {
-		link->request_io_ctx = (void *) (link + 1);
+/** Start the I/O thread
+ *
+ * It has its own event list, and its own connections to each home
+ * server.
+ */
+static int mod_shared_start(CONF_SECTION const *cs, rlm_radius_t const *inst)
+{
+	rlm_radius_shared_t	*shared = inst->shared;
+	int			rcode;
+
+	shared->el = fr_event_list_alloc(shared, NULL, NULL);
+	if (!shared->el) {
+		cf_log_err(cs, "Failed creating event list for the I/O thread: %s", fr_strerror());
+		return -1;
 	}
+	shared->kq = fr_event_list_kq(shared->el);
 
-	/*
-	 *	Add the request to the outoging queue, and associate
-	 *	it with the request.
-	 */
-	fr_dlist_insert_tail(&c->queued, &link->entry);
-	link->request = request;
-	link->c = c;
-	link->waiting = false;
+	shared->aq = fr_atomic_queue_create(shared, RLM_RADIUS_SHARED_MAX);
+	if (!shared->aq) {
+		cf_log_err(cs, "Failed creating queue for the I/O thread");
+	error:
+		mod_shared_stop(shared);
+		return -1;
+	}
 
-	talloc_set_destructor(link, mod_link_free);
+	shared->ident = fr_event_user_insert(shared->el, mod_shared_evfilt_user, shared);
+	if (!shared->ident) {
+		cf_log_err(cs, "Failed updating event list: %s", fr_strerror());
+		goto error;
+	}
 
-	(void) request_data_add(request, c, 0, link, true, true, false);
+	if (fr_event_post_insert(shared->el, mod_shared_post, shared) < 0) {
+		cf_log_err(cs, "Failed updating event list: %s", fr_strerror());
+		goto error;
+	}
 
-//	inst->client_io->add(request, c->client_io_ctx, link->request_io_ctx);
+	shared->thread = talloc_zero(shared, rlm_radius_thread_t);
+	if (!shared->thread) goto error;
 
-	// insert resumption handler
-	// insert max_request_timeout
-	// retransmission timeouts, etc. MUST be handled by the IO handler, which gets REQUEST in it's write() routine
-	// return yield
+	if (mod_thread_init(cs, inst, shared->thread, shared->el) < 0) goto error;
 
-	/*
-	 *	If there are no pending writes, enable the write
-	 *	callback.  It will wake up and write the packets to
-	 *	the socket.
-	 */
-	if (!c->pending) {
-		c->pending = true;
-		mod_radius_fd_active(c);
+	atomic_store(&shared->exiting, false);
+
+	rcode = pthread_create(&shared->pthread_id, NULL, mod_shared_thread, shared);
+	if (rcode != 0) {
+		cf_log_err(cs, "Failed creating I/O thread: %s", fr_syserror(rcode));
+		goto error;
 	}
+	shared->running = true;
 
 	return 0;
 }
 
-/** Send packets outbound.
+/** Use the I/O thread for a worker, starting it if necessary
  *
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_process(void *instance, void *thread, REQUEST *request)
+static int mod_shared_attach(CONF_SECTION const *cs, rlm_radius_t const *inst, rlm_radius_thread_t *t)
 {
-	int rcode;
-	rlm_radius_t *inst = instance;
-	rlm_radius_thread_t *t = talloc_get_type_abort(thread, rlm_radius_thread_t);
-	rlm_radius_connection_t *c;
-	fr_dlist_t *entry;
+	rlm_radius_shared_t	*shared = inst->shared;
+	rlm_radius_worker_t	*worker;
 
 	/*
-	 *	Another connection has closed and moved it's requests
-	 *	back to the main thread.  Recycle them through to
-	 *	other connections.
+	 *	The slot is freed when the I/O thread stops, as it may
+	 *	still have requests for us after we've detached.
 	 */
-	if (t->pending) {
-		mod_clear_backlog(t);
+	worker = talloc_zero(NULL, rlm_radius_worker_t);
+	if (!worker) return -1;
+
+	worker->shared = shared;
+	worker->kq = fr_event_list_kq(t->el);
+	FR_DLIST_INIT(worker->entry);
+
+	worker->aq = fr_atomic_queue_create(worker, RLM_RADIUS_SHARED_MAX_WORKER);
+	if (!worker->aq) {
+		cf_log_err(cs, "Failed creating queue for replies from the I/O thread");
+	error:
+		talloc_free(worker);
+		return -1;
 	}
 
-	entry = FR_DLIST_FIRST(t->active);
-	if (!entry) {
-		REDEBUG("No active connections");
-		return RLM_MODULE_FAIL;
+	worker->ident = fr_event_user_insert(t->el, mod_worker_evfilt_user, t);
+	if (!worker->ident) {
+		cf_log_err(cs, "Failed updating event list: %s", fr_strerror());
+		goto error;
 	}
 
-	/*
-	 *	Pick the first one for now.
-	 */
-	c = fr_ptr_to_type(rlm_radius_connection_t, entry, entry);
+	if (fr_event_post_insert(t->el, mod_worker_post, t) < 0) {
+		cf_log_err(cs, "Failed updating event list: %s", fr_strerror());
+	error2:
+		(void) fr_event_user_delete(t->el, mod_worker_evfilt_user, t);
+		goto error;
+	}
 
-	// @todo - find the "most recently started" connection which has a response
-	// @todo - check the connection busy-ness before calling mod_add()
+	pthread_mutex_lock(&shared->mutex);
 
-	rcode = mod_add(inst, c, request);
-	if (rcode < 0) return RLM_MODULE_FAIL;
+	if (!shared->running && (mod_shared_start(cs, inst) < 0)) {
+		pthread_mutex_unlock(&shared->mutex);
+		(void) fr_event_post_delete(t->el, mod_worker_post, t);
+		goto error2;
+	}
 
-	// @todo otherwise return RLM_MODULE_YIELD
-	// i.e. we always yield, and rely on the event loop to wake up the request
+	worker->alive = true;
+	fr_dlist_insert_tail(&shared->workers, &worker->entry);
+	shared->num_workers++;
 
-	// @todo - create or add another connection
+	pthread_mutex_unlock(&shared->mutex);
 
-	return RLM_MODULE_FAIL;
-}
+	t->worker = worker;
 
+	return 0;
+}
 
-/** Bootstrap the module
- *
- * Bootstrap I/O and type submodules.
+/** Stop using the I/O thread
  *
- * @param[in] instance	Ctx data for this module
- * @param[in] conf    our configuration section parsed to give us instance.
- * @return
- *	- 0 on success.
- *	- -1 on failure.
+ * Replies for our requests are thrown away from now on.  The last
+ * worker stops the I/O thread.
  */
-static int mod_bootstrap(void *instance, CONF_SECTION *conf)
+static void mod_shared_detach(rlm_radius_thread_t *t)
 {
-	rlm_radius_t *inst = talloc_get_type_abort(instance, rlm_radius_t);
+	rlm_radius_shared_t	*shared = t->inst->shared;
+	rlm_radius_worker_t	*worker = t->worker;
+	bool			last;
 
-	inst->name = cf_section_name2(conf);
-	if (!inst->name) inst->name = cf_section_name1(conf);
+	(void) fr_event_post_delete(t->el, mod_worker_post, t);
 
-	FR_TIMEVAL_BOUND_CHECK("timers.connection", &inst->connection_timeout, >=, 1, 0);
-	FR_TIMEVAL_BOUND_CHECK("timers.connection", &inst->connection_timeout, <=, 30, 0);
+	pthread_mutex_lock(&shared->mutex);
+	worker->alive = false;
+	last = (--shared->num_workers == 0);
+	pthread_mutex_unlock(&shared->mutex);
 
-	FR_TIMEVAL_BOUND_CHECK("timers.reconnect", &inst->reconnection_delay, >=, 5, 0);
-	FR_TIMEVAL_BOUND_CHECK("timers.reconned", &inst->reconnection_delay, <=, 300, 0);
+	(void) fr_event_user_delete(t->el, mod_worker_evfilt_user, t);
+	t->worker = NULL;
 
-	FR_TIMEVAL_BOUND_CHECK("timers.idle", &inst->connection_timeout, >=, 30, 0);
-	FR_TIMEVAL_BOUND_CHECK("timers.idle", &inst->connection_timeout, <=, 600, 0);
+	if (last) mod_shared_stop(shared);
+}
 
-	rad_assert(inst->client_io->io_inst_size > 0);
+/** Start the replication thread
+ *
+ * Called with the replication mutex held.
+ */
+static int mod_replicate_start(CONF_SECTION const *cs, rlm_radius_replicate_t *replicate)
+{
+	int rcode;
+
+	replicate->el = fr_event_list_alloc(replicate, NULL, NULL);
+	if (!replicate->el) {
+		cf_log_err(cs, "Failed creating event list for the replication thread: %s", fr_strerror());
+		return -1;
+	}
 
-	if (!inst->client_io->bootstrap) return 0;
+	replicate->last = replicate->last_report = fr_time();
+	atomic_store(&replicate->exiting, false);
 
-	if (inst->client_io->bootstrap(inst->client_io_instance, inst->client_io_conf) < 0) {
-		cf_log_err(inst->client_io_conf, "Bootstrap failed for \"%s\"",
-			   inst->client_io->name);
+	if (mod_replicate_timer_insert(replicate) < 0) {
+		cf_log_err(cs, "Failed inserting replication timer: %s", fr_strerror());
+	error:
+		TALLOC_FREE(replicate->el);
 		return -1;
 	}
 
+	rcode = pthread_create(&replicate->pthread_id, NULL, mod_replicate_thread, replicate);
+	if (rcode != 0) {
+		cf_log_err(cs, "Failed creating replication thread: %s", fr_syserror(rcode));
+		goto error;
+	}
+	replicate->running = true;
+
 	return 0;
 }
 
-
-/** Instantiate the module
- *
- * Instantiate I/O and type submodules.
+/** Stop the replication thread, and throw away the packets it didn't send
  *
- * @param[in] instance	Ctx data for this module
- * @param[in] conf	our configuration section parsed to give us instance.
- * @return
- *	- 0 on success.
- *	- -1 on failure.
+ * Called with the replication mutex held.
  */
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
+static void mod_replicate_stop(rlm_radius_replicate_t *replicate)
 {
-	rlm_radius_t *inst = talloc_get_type_abort(instance, rlm_radius_t);
+	rlm_radius_t const		*inst = replicate->inst;
+	rlm_radius_replica_packet_t	*packet;
+	uint32_t			i;
 
-	if (!inst->client_io->instantiate) return 0;
+	if (!replicate->running) return;
+
+	atomic_store(&replicate->exiting, true);
+	(void) pthread_join(replicate->pthread_id, NULL);
+	replicate->running = false;
+
+	for (i = 0; i < inst->num_home_servers; i++) {
+		rlm_radius_replica_t *replica = &replicate->replica[i];
 
-	if (inst->client_io->instantiate(inst->client_io_instance, inst->client_io_conf) < 0) {
-		cf_log_err(inst->client_io_conf, "Instantiate failed for \"%s\"",
-			   inst->client_io->name);
+		mod_replica_close(inst, replica);
+
+		if (replica->pending) {
+			free(replica->pending);
+			replica->pending = NULL;
+		}
+
+		while (fr_atomic_queue_pop(replica->aq, (void **) &packet)) free(packet);
+
+		INFO("%s - Replicated %" PRIu64 " of %" PRIu64 " packets to %s.  %" PRIu64 " were dropped, "
+		     "and %" PRIu64 " failed", inst->name, replica->sent, (uint64_t) atomic_load(&replica->queued),
+		     replica->home_server->name, (uint64_t) atomic_load(&replica->dropped), replica->failed);
+	}
+
+	TALLOC_FREE(replicate->el);
+}
+
+/** Let a worker replicate packets, starting the replication thread if necessary
+ *
+ */
+static int mod_replicate_attach(CONF_SECTION const *cs, rlm_radius_replicate_t *replicate)
+{
+	pthread_mutex_lock(&replicate->mutex);
+
+	if (!replicate->running && (mod_replicate_start(cs, replicate) < 0)) {
+		pthread_mutex_unlock(&replicate->mutex);
 		return -1;
 	}
+	replicate->num_workers++;
+
+	pthread_mutex_unlock(&replicate->mutex);
 
 	return 0;
 }
 
-/** Detach thread-specific data
+/** The last worker stops the replication thread
  *
- *  Which gives us a chance to clean up.
  */
-static int mod_thread_detach(void *thread)
+static void mod_replicate_detach(rlm_radius_replicate_t *replicate)
 {
-	rlm_radius_thread_t *t = talloc_get_type_abort(thread, rlm_radius_thread_t);
-//	rlm_radius_t *inst = t->inst;
-	fr_dlist_t *entry, *next;
-
-	/*
-	 *	Free up all of the connections.
-	 */
-	for (entry = FR_DLIST_FIRST(t->frozen);
-	     entry != NULL;
-	     entry = next) {
-		rlm_radius_connection_t *c;
+	pthread_mutex_lock(&replicate->mutex);
+	if (--replicate->num_workers == 0) mod_replicate_stop(replicate);
+	pthread_mutex_unlock(&replicate->mutex);
+}
 
-		c = fr_ptr_to_type(rlm_radius_connection_t, entry, entry);
+/** Start the replay thread
+ *
+ * Called with the replay mutex held.
+ */
+static int mod_replay_start(CONF_SECTION const *cs, rlm_radius_replay_t *replay)
+{
+	rlm_radius_t const	*inst = replay->inst;
+	int			rcode;
 
-		next = FR_DLIST_NEXT(t->frozen, entry);
-		talloc_free(c);
+	replay->el = fr_event_list_alloc(replay, NULL, NULL);
+	if (!replay->el) {
+		cf_log_err(cs, "Failed creating event list for the spool replay thread: %s", fr_strerror());
+		return -1;
 	}
 
-	for (entry = FR_DLIST_FIRST(t->active);
-	     entry != NULL;
-	     entry = next) {
-		rlm_radius_connection_t *c;
-
-		c = fr_ptr_to_type(rlm_radius_connection_t, entry, entry);
+	/*
+	 *	Packets which were in flight when the thread last
+	 *	stopped weren't acknowledged, and are sent again.
+	 */
+	radius_spool_start(inst->spool, &replay->read);
+	replay->head = replay->num = 0;
+	replay->tokens = 0;
+	replay->next_open = 0;
+	replay->last = fr_time();
+	atomic_store(&replay->exiting, false);
+
+	if (mod_replay_timer_insert(replay) < 0) {
+		cf_log_err(cs, "Failed inserting spool replay timer: %s", fr_strerror());
+	error:
+		TALLOC_FREE(replay->el);
+		return -1;
+	}
 
-		next = FR_DLIST_NEXT(t->active, entry);
-		talloc_free(c);
+	rcode = pthread_create(&replay->pthread_id, NULL, mod_replay_thread, replay);
+	if (rcode != 0) {
+		cf_log_err(cs, "Failed creating spool replay thread: %s", fr_syserror(rcode));
+		goto error;
 	}
+	replay->running = true;
 
-	for (entry = FR_DLIST_FIRST(t->closed);
-	     entry != NULL;
-	     entry = next) {
-		rlm_radius_connection_t *c;
+	return 0;
+}
 
-		c = fr_ptr_to_type(rlm_radius_connection_t, entry, entry);
+/** Stop the replay thread
+ *
+ * Called with the replay mutex held.  Packets it didn't finish
+ * replaying stay in the spool.
+ */
+static void mod_replay_stop(rlm_radius_replay_t *replay)
+{
+	rlm_radius_t const	*inst = replay->inst;
+	radius_spool_stats_t	stats;
 
-		next = FR_DLIST_NEXT(t->closed, entry);
-		talloc_free(c);
-	}
+	if (!replay->running) return;
 
-	/*
-	 *	Now that all of the connections are closed, all of the
-	 *	requests we manage should be in t->queued.
-	 */
-	for (entry = FR_DLIST_FIRST(t->queued);
-	     entry != NULL;
-	     entry = next) {
-		REQUEST *request;
-		rlm_radius_link_t *link;
+	atomic_store(&replay->exiting, true);
+	(void) pthread_join(replay->pthread_id, NULL);
+	replay->running = false;
 
-		link = fr_ptr_to_type(rlm_radius_link_t, entry, entry);
+	mod_replay_close(replay);
 
-		next = FR_DLIST_NEXT(t->queued, entry);
+	radius_spool_stats(inst->spool, &stats);
+	INFO("%s - Replayed %" PRIu64 " spooled packets.  %" PRIu64 " are still in the spool",
+	     inst->name, (uint64_t) atomic_load(&replay->replayed), stats.records);
 
-		request = link->request;
-		talloc_free(link);
+	TALLOC_FREE(replay->el);
+}
 
-		unlang_resumable(request);
+/** Let a worker spool packets, starting the replay thread if necessary
+ *
+ */
+static int mod_replay_attach(CONF_SECTION const *cs, rlm_radius_replay_t *replay)
+{
+	pthread_mutex_lock(&replay->mutex);
+
+	if (!replay->running && (mod_replay_start(cs, replay) < 0)) {
+		pthread_mutex_unlock(&replay->mutex);
+		return -1;
 	}
+	replay->num_workers++;
+
+	pthread_mutex_unlock(&replay->mutex);
 
 	return 0;
 }
 
-static int mod_thread_instantiate(CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+/** The last worker stops the replay thread
+ *
+ */
+static void mod_replay_detach(rlm_radius_replay_t *replay)
+{
+	pthread_mutex_lock(&replay->mutex);
+	if (--replay->num_workers == 0) mod_replay_stop(replay);
+	pthread_mutex_unlock(&replay->mutex);
+}
+
+/** Detach thread-specific data
+ *
+ *  Which gives us a chance to clean up.
+ */
+static int mod_thread_detach(void *thread)
 {
-	rlm_radius_t *inst = talloc_get_type_abort(instance, rlm_radius_t);
 	rlm_radius_thread_t *t = talloc_get_type_abort(thread, rlm_radius_thread_t);
-	rlm_radius_connection_t *c;
 
-	c = talloc_zero(t, rlm_radius_connection_t);
-	c->name = "<pending>";
-	c->inst = inst;
-	c->thread = t;
-	c->el = el;
+	if (t->inst->replay) mod_replay_detach(t->inst->replay);
 
-	FR_DLIST_INIT(c->entry);
-	FR_DLIST_INIT(c->queued);
-	FR_DLIST_INIT(c->sent);
+	if (t->inst->replicate) {
+		mod_replicate_detach(t->inst->replicate);
+		return 0;
+	}
 
-	/*
-	 *	Open ONE connection.  mod_process() will open more if necessary.
-	 */
-	 c->client_io_ctx = talloc_zero_array(t, uint8_t, inst->client_io->io_inst_size);
-	if (!c->client_io_ctx) {
-		cf_log_err(cs, "Failed allocating IO instance");
-		return -1;
+	if (t->worker) {
+		mod_shared_detach(t);
+		return 0;
 	}
 
-	talloc_set_destructor(c, mod_radius_conn_free);
+	mod_thread_free(t);
+
+	return 0;
+}
 
-	FR_DLIST_INIT(t->queued);
-	FR_DLIST_INIT(t->active);
-	FR_DLIST_INIT(t->frozen);
-	FR_DLIST_INIT(t->closed);
+static int mod_thread_instantiate(CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_radius_t *inst = talloc_get_type_abort(instance, rlm_radius_t);
+	rlm_radius_thread_t *t = talloc_get_type_abort(thread, rlm_radius_thread_t);
 
 	/*
-	 *	This opens the outbound connection
+	 *	We don't open connections, and only send packets from
+	 *	the replication thread.
 	 */
-	c->conn = fr_connection_alloc(c, el, &inst->connection_timeout, &inst->reconnection_delay,
-				      mod_radius_conn_init, mod_radius_conn_open, inst->client_io->close,
-				      inst->name, c);
-	if (c->conn == NULL) return -1;
+	if (inst->replicate) {
+		t->inst = inst;
+		t->el = el;
+
+		return mod_replicate_attach(cs, inst->replicate);
+	}
 
 	/*
-	 *	We have to catch errors on failed.
+	 *	Spooled packets are replayed by their own thread.
 	 */
-	fr_connection_failed_func(c->conn, mod_radius_conn_failed);
+	if (inst->replay && (mod_replay_attach(cs, inst->replay) < 0)) return -1;
 
 	/*
-	 *	Add the connection to the "closed" list, because it's
-	 *	not open, and there are no requests outstanding on it.
+	 *	The I/O thread owns the connections.
 	 */
-	fr_dlist_insert_tail(&t->closed, &c->entry);
+	if (inst->shared) {
+		t->inst = inst;
+		t->el = el;
 
-	fr_connection_start(c->conn);
+		return mod_shared_attach(cs, inst, t);
+	}
 
-	return 0;
+	return mod_thread_init(cs, inst, t, el);
 }
 
-
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -754,6 +4492,7 @@ rad_module_t rlm_radius = {
 	.name		= "radius",
 	.type		= RLM_TYPE_THREAD_SAFE | RLM_TYPE_RESUMABLE,
 	.inst_size	= sizeof(rlm_radius_t),
+	.thread_inst_size = sizeof(rlm_radius_thread_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
@@ -16,6 +16,7 @@
 #ifndef _RLM_RADIUS_H
 #define _RLM_RADIUS_H
 #include <freeradius-devel/connection.h>
+#include <sys/uio.h>
 
 /*
  * $Id$
@@ -36,6 +37,70 @@ typedef int (*fr_radius_client_process_t)(void *thread, REQUEST *request);
  */
 typedef char *(*fr_radius_client_name_t)(TALLOC_CTX *ctx, void *uctx);
 
+/** Open a new socket for a connection
+ *
+ * @param[out] fd_out		Where to write the new file descriptor.
+ * @param[in] io_ctx		Per-connection data for the IO module, of io_inst_size bytes.
+ * @param[in] io_instance	The IO module's instance data.
+ * @return
+ *	- #FR_CONNECTION_STATE_CONNECTING	if a file descriptor was successfully created.
+ *	- #FR_CONNECTION_STATE_FAILED		if we could not open a file descriptor.
+ */
+typedef fr_connection_state_t (*fr_radius_client_init_t)(int *fd_out, void *io_ctx, void const *io_instance);
+
+/** Close a socket opened by #fr_radius_client_init_t
+ *
+ */
+typedef void (*fr_radius_client_close_t)(int fd, void *io_ctx);
+
+/** Write one encoded packet to a socket.
+ *
+ * @return
+ *	- >0 the number of bytes written.
+ *	- 0 if the socket would block.
+ *	- <0 on error.  The connection is re-opened.
+ */
+typedef ssize_t (*fr_radius_client_write_t)(int fd, void *io_ctx, uint8_t const *packet, size_t packet_len);
+
+/** Read one packet from a socket.
+ *
+ * @return
+ *	- >0 the length of the packet.
+ *	- 0 if there's no more data.
+ *	- <0 on error.  The connection is re-opened.
+ */
+typedef ssize_t (*fr_radius_client_read_t)(int fd, void *io_ctx, uint8_t *buffer, size_t buffer_len);
+
+/** Write several encoded packets to a socket, with as few system calls as possible.
+ *
+ * @return
+ *	- >=0 the number of packets written.  They're always the first ones in "packets".
+ *	- <0 on error.  The connection is re-opened.
+ */
+typedef int (*fr_radius_client_write_batch_t)(int fd, void *io_ctx, struct iovec *packets, int num);
+
+/** Read several packets from a socket, with as few system calls as possible.
+ *
+ * The iov_len of each buffer is updated to the length of the packet read into it.
+ *
+ * @return
+ *	- >0 the number of packets read.
+ *	- 0 if there's no more data.
+ *	- <0 on error.  The connection is re-opened.
+ */
+typedef int (*fr_radius_client_read_batch_t)(int fd, void *io_ctx, struct iovec *buffers, int num);
+
+/** Write data which a stream transport has buffered.
+ *
+ * Stream transports may accept a packet, and only be able to write
+ * part of it.  The rest is written when the socket is writable again.
+ *
+ * @return
+ *	- >0 if there is still data to write.
+ *	- 0 if everything has been written.
+ *	- <0 on error.  The connection is re-opened.
+ */
+typedef int (*fr_radius_client_flush_t)(int fd, void *io_ctx);
 
 /** Public structure describing an I/O path for an outgoing socket.
  *
@@ -50,13 +115,15 @@ typedef struct fr_radius_client_io_t {
 	size_t				request_inst_size;	//!< size of the data to allocate per-request.
 
 
-	fr_connection_init_t		init;			//!< initialize a socket using thread instance data
-	fr_connection_open_t		open;			//!< open a socket using thread instance data
-	fr_connection_close_t       	close;			//!< close a socket using thread instance data
-	fr_radius_client_name_t		get_name;			//!< get the name of this socket.
-	// get name
-	// write
-	// read
+	fr_radius_client_init_t		init;			//!< initialize a socket using thread instance data
+	fr_connection_open_t		open;			//!< finish opening a socket, e.g. a TLS handshake.  Optional.
+	fr_radius_client_close_t       	close;			//!< close a socket using thread instance data
+	fr_radius_client_name_t		get_name;		//!< get the name of this socket.
+	fr_radius_client_write_t	write;			//!< write a packet to the socket.
+	fr_radius_client_read_t		read;			//!< read a packet from the socket.
+	fr_radius_client_write_batch_t	write_batch;		//!< write many packets to the socket.  Optional.
+	fr_radius_client_read_batch_t	read_batch;		//!< read many packets from the socket.  Optional.
+	fr_radius_client_flush_t	flush;			//!< write buffered data to the socket.  Optional.
 	// error
 } fr_radius_client_io_t;
 
@@ -1,3 +1,5 @@
 TARGET		:= rlm_radius.a
 
-SOURCES		:= rlm_radius.c
+SOURCES		:= rlm_radius.c spool.c
+
+TGT_PREREQS	:= libfreeradius-radius.a
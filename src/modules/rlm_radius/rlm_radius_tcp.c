@@ -0,0 +1,723 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_radius_tcp.c
+ * @brief RADIUS client TCP and TLS (RadSec) transport.
+ *
+ * Each connection is a TCP stream with its own 256 IDs.  Many
+ * requests are outstanding on a connection at once, and the replies
+ * can come back in any order.
+ *
+ * Packets are written to an output buffer, and each batch goes out
+ * with as few system calls as the socket allows.  Nagle is disabled,
+ * as we do our own batching.
+ *
+ * @copyright 2017 The FreeRADIUS server project.
+ */
+RCSID("$Id$")
+
+#include <netinet/tcp.h>
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/net.h>
+#include <freeradius-devel/rad_assert.h>
+
+#ifdef WITH_TLS
+#include <pthread.h>
+#endif
+
+#include "rlm_radius.h"
+
+/*
+ *	How much data a connection can have waiting to be written.
+ */
+#define RLM_RADIUS_TCP_MAX_QUEUED (64 * MAX_PACKET_LEN)
+
+#ifdef WITH_TLS
+/*
+ *	Room left in the output buffer for the TLS record headers and
+ *	MACs of a batch of packets.
+ */
+#define RLM_RADIUS_TCP_TLS_SLACK (16384)
+
+/** The last TLS session, for resuming new connections
+ *
+ * All of the connections to a home server share it, across all of
+ * the worker threads.
+ */
+typedef struct {
+	pthread_mutex_t		mutex;
+	SSL_SESSION		*session;		//!< May be NULL.
+} rlm_radius_tcp_resume_t;
+#endif
+
+/** Static configuration for the module.
+ *
+ */
+typedef struct rlm_radius_tcp_t {
+	fr_ipaddr_t		dst_ipaddr;		//!< IP of the home server.
+	fr_ipaddr_t		src_ipaddr;		//!< IP we open our socket on.
+	uint16_t		dst_port;		//!< Port of the home server.
+
+#ifdef WITH_TLS
+	fr_tls_conf_t		*tls;			//!< TLS configuration, if this is RadSec.
+	rlm_radius_tcp_resume_t	*resume;		//!< Session to resume.
+#endif
+} rlm_radius_tcp_t;
+
+/** Per-connection data
+ *
+ */
+typedef struct {
+	rlm_radius_tcp_t const	*inst;			//!< Our module instance.
+	int			fd;			//!< The socket.
+
+	uint8_t			*rx;			//!< Part of a packet we've read.
+	size_t			rx_used;		//!< How much data is in "rx".
+
+	uint8_t			*tx;			//!< Data we haven't yet written.
+	size_t			tx_used;		//!< How much data is in "tx".
+
+#ifdef WITH_TLS
+	REQUEST			*request;		//!< For logging, and OpenSSL callbacks.
+	tls_session_t		*tls_session;		//!< TLS state for the connection.
+
+	uint8_t			*clean;			//!< Packets which haven't been encrypted.  They
+							//!< wait here until the handshake is done.
+	size_t			clean_used;		//!< How much data is in "clean".
+	bool			resume_saved;		//!< We've saved a session after reading data.
+#endif
+} rlm_radius_tcp_connection_t;
+
+static const CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, rlm_radius_tcp_t, dst_ipaddr) },
+	{ FR_CONF_OFFSET("ipv4addr", FR_TYPE_IPV4_ADDR, rlm_radius_tcp_t, dst_ipaddr) },
+	{ FR_CONF_OFFSET("ipv6addr", FR_TYPE_IPV6_ADDR, rlm_radius_tcp_t, dst_ipaddr) },
+
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, rlm_radius_tcp_t, dst_port) },
+
+	{ FR_CONF_OFFSET("src_ipaddr", FR_TYPE_COMBO_IP_ADDR, rlm_radius_tcp_t, src_ipaddr) },
+	{ FR_CONF_OFFSET("src_ipv4addr", FR_TYPE_IPV4_ADDR, rlm_radius_tcp_t, src_ipaddr) },
+	{ FR_CONF_OFFSET("src_ipv6addr", FR_TYPE_IPV6_ADDR, rlm_radius_tcp_t, src_ipaddr) },
+
+	CONF_PARSER_TERMINATOR
+};
+
+/** Write as much of the output buffer as the socket will take
+ *
+ * @return
+ *	- >0 if there is still data to write.
+ *	- 0 if everything has been written.
+ *	- <0 on error.
+ */
+static int mod_flush(UNUSED int fd, void *io_ctx)
+{
+	rlm_radius_tcp_connection_t	*conn = io_ctx;
+	ssize_t				rcode;
+
+	if (!conn->tx_used) return 0;
+
+	rcode = write(conn->fd, conn->tx, conn->tx_used);
+	if (rcode < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 1;
+
+		fr_strerror_printf("%s", fr_syserror(errno));
+		return -1;
+	}
+
+	if ((size_t) rcode < conn->tx_used) memmove(conn->tx, conn->tx + rcode, conn->tx_used - rcode);
+	conn->tx_used -= rcode;
+
+	return (conn->tx_used > 0);
+}
+
+#ifdef WITH_TLS
+/** Use the last session to the home server, if there is one
+ *
+ */
+static void mod_tls_resume_load(rlm_radius_tcp_t const *inst, SSL *ssl)
+{
+	rlm_radius_tcp_resume_t *resume = inst->resume;
+
+	pthread_mutex_lock(&resume->mutex);
+	if (resume->session) SSL_set_session(ssl, resume->session);
+	pthread_mutex_unlock(&resume->mutex);
+}
+
+/** Save the session, so that new connections can resume it
+ *
+ */
+static void mod_tls_resume_save(rlm_radius_tcp_t const *inst, SSL *ssl)
+{
+	rlm_radius_tcp_resume_t	*resume = inst->resume;
+	SSL_SESSION		*session;
+
+	session = SSL_get1_session(ssl);
+	if (!session) return;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	if (!SSL_SESSION_is_resumable(session)) {
+		SSL_SESSION_free(session);
+		return;
+	}
+#endif
+
+	pthread_mutex_lock(&resume->mutex);
+	if (resume->session) SSL_SESSION_free(resume->session);
+	resume->session = session;
+	pthread_mutex_unlock(&resume->mutex);
+}
+
+static int _mod_tls_resume_free(rlm_radius_tcp_resume_t *resume)
+{
+	if (resume->session) SSL_SESSION_free(resume->session);
+	pthread_mutex_destroy(&resume->mutex);
+
+	return 0;
+}
+
+/** Move data which OpenSSL wants to send into the output buffer
+ *
+ */
+static int mod_tls_queue(rlm_radius_tcp_connection_t *conn)
+{
+	tls_session_t	*tls_session = conn->tls_session;
+	int		rcode;
+
+	if (tls_session->dirty_out.used > 0) {
+		if ((conn->tx_used + tls_session->dirty_out.used) > RLM_RADIUS_TCP_MAX_QUEUED) {
+		full:
+			fr_strerror_printf("Too much TLS data to write");
+			return -1;
+		}
+
+		memcpy(conn->tx + conn->tx_used, tls_session->dirty_out.data, tls_session->dirty_out.used);
+		conn->tx_used += tls_session->dirty_out.used;
+		tls_session->dirty_out.used = 0;
+	}
+
+	while (BIO_ctrl_pending(tls_session->from_ssl) > 0) {
+		if (conn->tx_used == RLM_RADIUS_TCP_MAX_QUEUED) goto full;
+
+		rcode = BIO_read(tls_session->from_ssl, conn->tx + conn->tx_used,
+				 RLM_RADIUS_TCP_MAX_QUEUED - conn->tx_used);
+		if (rcode <= 0) break;
+
+		conn->tx_used += rcode;
+	}
+
+	return 0;
+}
+
+/** Encrypt the packets which are waiting, all at once
+ *
+ * OpenSSL splits them into as few records as it can.
+ */
+static int mod_tls_encrypt(rlm_radius_tcp_connection_t *conn)
+{
+	tls_session_t	*tls_session = conn->tls_session;
+	int		rcode;
+
+	if (!conn->clean_used || !SSL_is_init_finished(tls_session->ssl)) return 0;
+
+	rcode = SSL_write(tls_session->ssl, conn->clean, conn->clean_used);
+	if (rcode <= 0) {
+		tls_log_io_error(conn->request, tls_session, rcode, "Failed in SSL_write");
+		fr_strerror_printf("Failed encrypting packets");
+		return -1;
+	}
+
+	/*
+	 *	Memory BIOs never block, so it's all or nothing.
+	 */
+	rad_assert((size_t) rcode == conn->clean_used);
+	conn->clean_used = 0;
+
+	return mod_tls_queue(conn);
+}
+
+/** Start the TLS handshake
+ *
+ * The rest of the handshake is done by mod_recv_tls(), as the home
+ * server's data arrives.  Packets written before then are kept, and
+ * sent once the handshake is done.
+ */
+static int mod_tls_start(rlm_radius_tcp_connection_t *conn)
+{
+	rlm_radius_tcp_t const	*inst = conn->inst;
+	tls_session_t		*tls_session;
+	int			rcode;
+
+	tls_session = conn->tls_session = tls_session_init_client(NULL, inst->tls);
+	if (!tls_session) {
+		fr_strerror_printf("Failed creating TLS session");
+		return -1;
+	}
+
+	conn->request = SSL_get_ex_data(tls_session->ssl, FR_TLS_EX_INDEX_REQUEST);
+	conn->clean = talloc_array(tls_session, uint8_t, RLM_RADIUS_TCP_MAX_QUEUED / 2);
+	if (!conn->clean) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+	conn->clean_used = 0;
+	conn->resume_saved = false;
+
+	mod_tls_resume_load(inst, tls_session->ssl);
+
+	/*
+	 *	This writes the ClientHello, and then returns, as
+	 *	there's nothing to read yet.
+	 */
+	rcode = SSL_do_handshake(tls_session->ssl);
+	if (rcode <= 0) {
+		int code = SSL_get_error(tls_session->ssl, rcode);
+
+		if ((code != SSL_ERROR_WANT_READ) && (code != SSL_ERROR_WANT_WRITE)) {
+			tls_log_io_error(conn->request, tls_session, rcode, "Failed in SSL_do_handshake");
+			fr_strerror_printf("Failed starting TLS handshake");
+			return -1;
+		}
+	}
+
+	if (mod_tls_queue(conn) < 0) return -1;
+
+	return (mod_flush(conn->fd, conn) < 0) ? -1 : 0;
+}
+
+/** Read decrypted data from a TLS connection
+ *
+ *  Continues the handshake if it hasn't finished.  Decrypted data
+ *  which the caller didn't ask for is kept in clean_out, for the
+ *  next call.
+ *
+ * @return
+ *	- <0 on error, or if the connection was closed.
+ *	- 0 if there is no data.
+ *	- >0 the amount of data read.
+ */
+static ssize_t mod_recv_tls(rlm_radius_tcp_connection_t *conn, uint8_t *buffer, size_t buffer_len)
+{
+	tls_session_t	*tls_session = conn->tls_session;
+	REQUEST		*request = conn->request;
+	bool		pending = true;
+	ssize_t		rcode;
+
+	while (tls_session->clean_out.used == 0) {
+		/*
+		 *	A record we've already read may hold more
+		 *	than one packet.  Try those before reading
+		 *	the socket, but only once for each read, as
+		 *	there may only be part of a record.
+		 */
+		if (pending && SSL_is_init_finished(tls_session->ssl) &&
+		    (SSL_pending(tls_session->ssl) || BIO_ctrl_pending(tls_session->into_ssl))) {
+			pending = false;
+			if (tls_session_recv(request, tls_session) < 0) goto error;
+			continue;
+		}
+
+		if (tls_record_reserve(&tls_session->dirty_in, FR_TLS_MAX_RECORD_SIZE) < 0) return -1;
+
+		rcode = read(conn->fd, tls_session->dirty_in.data, tls_session->dirty_in.size);
+		if (rcode < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+			fr_strerror_printf("Failed reading from socket: %s", fr_syserror(errno));
+			return -1;
+		}
+
+		if (rcode == 0) {
+			fr_strerror_printf("Connection closed by home server");
+			return -1;
+		}
+
+		tls_session->dirty_in.used = rcode;
+		pending = true;
+
+		if (!SSL_is_init_finished(tls_session->ssl)) {
+			if (!tls_session_handshake(request, tls_session)) {
+				fr_strerror_printf("Failed in TLS handshake");
+				return -1;
+			}
+
+			if (mod_tls_queue(conn) < 0) return -1;
+
+			/*
+			 *	Send the packets which were written
+			 *	during the handshake.  The caller
+			 *	flushes them when we're done reading.
+			 */
+			if (SSL_is_init_finished(tls_session->ssl)) {
+				mod_tls_resume_save(conn->inst, tls_session->ssl);
+				if (mod_tls_encrypt(conn) < 0) return -1;
+			}
+			continue;
+		}
+
+		if (tls_session_recv(request, tls_session) < 0) {
+		error:
+			fr_strerror_printf("Failed decrypting TLS data");
+			return -1;
+		}
+
+		/*
+		 *	TLS 1.3 session tickets arrive after the
+		 *	handshake, so save the session again.
+		 */
+		if (!conn->resume_saved) {
+			mod_tls_resume_save(conn->inst, tls_session->ssl);
+			conn->resume_saved = true;
+		}
+	}
+
+	return tls_session->record_to_buff(&tls_session->clean_out, buffer, buffer_len);
+}
+#endif
+
+/** Read data from a connection
+ *
+ * @return
+ *	- <0 on error, or if the connection was closed.
+ *	- 0 if there is no data.
+ *	- >0 the amount of data read.
+ */
+static ssize_t mod_recv(rlm_radius_tcp_connection_t *conn, uint8_t *buffer, size_t buffer_len)
+{
+	ssize_t rcode;
+
+#ifdef WITH_TLS
+	if (conn->tls_session) return mod_recv_tls(conn, buffer, buffer_len);
+#endif
+
+	rcode = read(conn->fd, buffer, buffer_len);
+	if (rcode < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+		fr_strerror_printf("Failed reading from socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if (rcode == 0) {
+		fr_strerror_printf("Connection closed by home server");
+		return -1;
+	}
+
+	return rcode;
+}
+
+/** Open a TCP socket
+ *
+ * The connect() finishes in the background.
+ */
+static fr_connection_state_t mod_init(int *fd_out, void *io_ctx, void const *io_instance)
+{
+	rlm_radius_tcp_t const		*inst = talloc_get_type_abort(io_instance, rlm_radius_tcp_t);
+	rlm_radius_tcp_connection_t	*conn = io_ctx;
+	int				fd, on = 1;
+
+	memset(conn, 0, sizeof(*conn));
+	conn->inst = inst;
+	conn->fd = -1;
+
+	fd = fr_socket_client_tcp(&inst->src_ipaddr, &inst->dst_ipaddr, inst->dst_port, true);
+	if (fd < 0) {
+		PERROR("Failed opening TCP socket");
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	/*
+	 *	We write whole batches of packets, so there's no
+	 *	point in the kernel holding on to them.
+	 */
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+		WARN("Failed setting TCP_NODELAY: %s", fr_syserror(errno));
+	}
+
+	conn->rx = talloc_array(NULL, uint8_t, MAX_PACKET_LEN);
+	conn->tx = talloc_array(NULL, uint8_t, RLM_RADIUS_TCP_MAX_QUEUED);
+	if (!conn->rx || !conn->tx) {
+		ERROR("Out of memory");
+		TALLOC_FREE(conn->rx);
+		TALLOC_FREE(conn->tx);
+		close(fd);
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	conn->fd = fd;
+	*fd_out = fd;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+/** Check that the connect() worked, and start TLS
+ *
+ * We're called when the socket is writable.
+ */
+static fr_connection_state_t mod_open(int fd, UNUSED fr_event_list_t *el, void *io_ctx)
+{
+	rlm_radius_tcp_connection_t	*conn = io_ctx;
+	int				error = 0;
+	socklen_t			len = sizeof(error);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) error = errno;
+	if (error) {
+		fr_strerror_printf("Failed connecting socket: %s", fr_syserror(error));
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+#ifdef WITH_TLS
+	if (conn->inst->tls && (mod_tls_start(conn) < 0)) return FR_CONNECTION_STATE_FAILED;
+#else
+	(void) conn;
+#endif
+
+	return FR_CONNECTION_STATE_CONNECTED;
+}
+
+/** Close the socket, and throw away anything we haven't written
+ *
+ */
+static void mod_close(int fd, void *io_ctx)
+{
+	rlm_radius_tcp_connection_t *conn = io_ctx;
+
+	if (fd >= 0) close(fd);
+	conn->fd = -1;
+
+#ifdef WITH_TLS
+	TALLOC_FREE(conn->tls_session);
+	conn->request = NULL;
+	conn->clean = NULL;
+	conn->clean_used = 0;
+#endif
+
+	TALLOC_FREE(conn->rx);
+	TALLOC_FREE(conn->tx);
+	conn->rx_used = 0;
+	conn->tx_used = 0;
+}
+
+/** Print the local and remote addresses of the socket
+ *
+ */
+static char *mod_get_name(TALLOC_CTX *ctx, void *io_ctx)
+{
+	rlm_radius_tcp_connection_t	*conn = io_ctx;
+	rlm_radius_tcp_t const		*inst = conn->inst;
+	struct sockaddr_storage		salocal;
+	socklen_t			salen = sizeof(salocal);
+	fr_ipaddr_t			src_ipaddr;
+	uint16_t			src_port = 0;
+	char const			*proto = "tcp";
+	char				src_buf[FR_IPADDR_STRLEN], dst_buf[FR_IPADDR_STRLEN];
+
+	memset(&src_ipaddr, 0, sizeof(src_ipaddr));
+	if ((getsockname(conn->fd, (struct sockaddr *) &salocal, &salen) < 0) ||
+	    (fr_ipaddr_from_sockaddr(&salocal, salen, &src_ipaddr, &src_port) < 0)) {
+		src_ipaddr = inst->src_ipaddr;
+	}
+
+#ifdef WITH_TLS
+	if (inst->tls) proto = "tls";
+#endif
+
+	return talloc_typed_asprintf(ctx, "proto %s local %s port %u remote %s port %u", proto,
+				     fr_inet_ntop(src_buf, sizeof(src_buf), &src_ipaddr), src_port,
+				     fr_inet_ntop(dst_buf, sizeof(dst_buf), &inst->dst_ipaddr), inst->dst_port);
+}
+
+/** Write many packets to the connection
+ *
+ * The packets are added to the output buffer, which is then written
+ * with one system call.  With TLS, they're encrypted together, too.
+ *
+ * @return the number of packets which were added to the buffer.
+ */
+static int mod_write_batch(int fd, void *io_ctx, struct iovec *packets, int num)
+{
+	rlm_radius_tcp_connection_t	*conn = io_ctx;
+	int				i;
+
+#ifdef WITH_TLS
+	if (conn->tls_session) {
+		for (i = 0; i < num; i++) {
+			size_t len = packets[i].iov_len;
+
+			if ((conn->clean_used + len) > (RLM_RADIUS_TCP_MAX_QUEUED / 2)) break;
+			if ((conn->tx_used + conn->clean_used + len + RLM_RADIUS_TCP_TLS_SLACK) >
+			    RLM_RADIUS_TCP_MAX_QUEUED) break;
+
+			memcpy(conn->clean + conn->clean_used, packets[i].iov_base, len);
+			conn->clean_used += len;
+		}
+
+		if (mod_tls_encrypt(conn) < 0) return -1;
+
+		goto flush;
+	}
+#endif
+
+	for (i = 0; i < num; i++) {
+		size_t len = packets[i].iov_len;
+
+		if ((conn->tx_used + len) > RLM_RADIUS_TCP_MAX_QUEUED) break;
+
+		memcpy(conn->tx + conn->tx_used, packets[i].iov_base, len);
+		conn->tx_used += len;
+	}
+
+#ifdef WITH_TLS
+flush:
+#endif
+	if (mod_flush(fd, conn) < 0) return -1;
+
+	return i;
+}
+
+/** Write one packet to the connection
+ *
+ */
+static ssize_t mod_write(int fd, void *io_ctx, uint8_t const *packet, size_t packet_len)
+{
+	struct iovec	iov;
+	int		rcode;
+
+	memcpy(&iov.iov_base, &packet, sizeof(packet)); /* const issues */
+	iov.iov_len = packet_len;
+
+	rcode = mod_write_batch(fd, io_ctx, &iov, 1);
+	if (rcode <= 0) return rcode;
+
+	return packet_len;
+}
+
+/** Read one packet from the connection
+ *
+ * Packets may arrive in pieces, so we keep what we have of the
+ * current one, and return it once it's complete.  Anything which
+ * isn't RADIUS closes the connection, as we can no longer tell where
+ * the next packet starts.
+ */
+static ssize_t mod_read(UNUSED int fd, void *io_ctx, uint8_t *buffer, size_t buffer_len)
+{
+	rlm_radius_tcp_connection_t	*conn = io_ctx;
+	size_t				packet_len;
+	ssize_t				rcode;
+
+	for (;;) {
+		if (conn->rx_used >= 4) {
+			packet_len = (conn->rx[2] << 8) | conn->rx[3];
+			if ((packet_len < RADIUS_HDR_LEN) || (packet_len > MAX_PACKET_LEN)) {
+				fr_strerror_printf("Received packet with invalid length %zu", packet_len);
+				return -1;
+			}
+
+			if (conn->rx_used >= packet_len) {
+				if (packet_len > buffer_len) {
+					fr_strerror_printf("Received packet is too large for the buffer");
+					return -1;
+				}
+
+				memcpy(buffer, conn->rx, packet_len);
+				memmove(conn->rx, conn->rx + packet_len, conn->rx_used - packet_len);
+				conn->rx_used -= packet_len;
+
+				return packet_len;
+			}
+		}
+
+		rcode = mod_recv(conn, conn->rx + conn->rx_used, MAX_PACKET_LEN - conn->rx_used);
+		if (rcode <= 0) return rcode;
+
+		conn->rx_used += rcode;
+	}
+}
+
+static int mod_bootstrap(void *instance, CONF_SECTION *cs)
+{
+	rlm_radius_tcp_t	*inst = talloc_get_type_abort(instance, rlm_radius_tcp_t);
+	CONF_SECTION		*tls_cs;
+
+	if (inst->dst_ipaddr.af == AF_UNSPEC) {
+		cf_log_err(cs, "No 'ipaddr' was specified in the 'tcp' section");
+		return -1;
+	}
+
+	if (!inst->dst_port) {
+		cf_log_err(cs, "No 'port' was specified in the 'tcp' section");
+		return -1;
+	}
+
+	/*
+	 *	Bind to the same address family as the home server.
+	 */
+	if (inst->src_ipaddr.af == AF_UNSPEC) {
+		memset(&inst->src_ipaddr, 0, sizeof(inst->src_ipaddr));
+		inst->src_ipaddr.af = inst->dst_ipaddr.af;
+		inst->src_ipaddr.prefix = (inst->dst_ipaddr.af == AF_INET) ? 32 : 128;
+	}
+
+	if (inst->src_ipaddr.af != inst->dst_ipaddr.af) {
+		cf_log_err(cs, "The 'src_ipaddr' and 'ipaddr' must be of the same address family");
+		return -1;
+	}
+
+	tls_cs = cf_section_find(cs, "tls", NULL);
+	if (tls_cs) {
+#ifdef WITH_TLS
+		inst->tls = tls_conf_parse_client(tls_cs);
+		if (!inst->tls) {
+			cf_log_err(tls_cs, "Failed parsing TLS configuration");
+			return -1;
+		}
+
+		inst->resume = talloc_zero(inst, rlm_radius_tcp_resume_t);
+		if (!inst->resume) return -1;
+
+		pthread_mutex_init(&inst->resume->mutex, NULL);
+		talloc_set_destructor(inst->resume, _mod_tls_resume_free);
+#else
+		cf_log_err(tls_cs, "TLS is not available in this build");
+		return -1;
+#endif
+	}
+
+	return 0;
+}
+
+extern fr_radius_client_io_t rlm_radius_tcp;
+fr_radius_client_io_t rlm_radius_tcp = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "radius_tcp",
+	.inst_size	= sizeof(rlm_radius_tcp_t),
+	.config		= module_config,
+	.bootstrap	= mod_bootstrap,
+
+	.io_inst_size	= sizeof(rlm_radius_tcp_connection_t),
+
+	.init		= mod_init,
+	.open		= mod_open,
+	.close		= mod_close,
+	.get_name	= mod_get_name,
+	.write		= mod_write,
+	.read		= mod_read,
+	.write_batch	= mod_write_batch,
+	.flush		= mod_flush,
+};
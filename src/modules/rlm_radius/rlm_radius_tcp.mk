@@ -0,0 +1,9 @@
+TARGETNAME	:= rlm_radius_tcp
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME).a
+endif
+
+SOURCES		:= rlm_radius_tcp.c
+
+TGT_PREREQS	:= libfreeradius-util.a
@@ -0,0 +1,293 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_radius_udp.c
+ * @brief RADIUS client UDP transport.
+ *
+ * Each connection is a connected UDP socket with its own source port,
+ * and therefore its own 256 IDs.
+ *
+ * @copyright 2017 The FreeRADIUS server project.
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "rlm_radius.h"
+
+/** Static configuration for the module.
+ *
+ */
+typedef struct rlm_radius_udp_t {
+	fr_ipaddr_t		dst_ipaddr;		//!< IP of the home server.
+	fr_ipaddr_t		src_ipaddr;		//!< IP we open our socket on.
+	uint16_t		dst_port;		//!< Port of the home server.
+	uint32_t		recv_buff;		//!< How big the kernel's receive buffer should be.
+
+	bool			recv_buff_is_set;	//!< Whether we were provided with a receive
+							//!< buffer value.
+} rlm_radius_udp_t;
+
+/** Per-connection data
+ *
+ */
+typedef struct {
+	rlm_radius_udp_t const	*inst;			//!< Our module instance.
+	int			fd;			//!< The socket.
+} rlm_radius_udp_connection_t;
+
+static const CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, rlm_radius_udp_t, dst_ipaddr) },
+	{ FR_CONF_OFFSET("ipv4addr", FR_TYPE_IPV4_ADDR, rlm_radius_udp_t, dst_ipaddr) },
+	{ FR_CONF_OFFSET("ipv6addr", FR_TYPE_IPV6_ADDR, rlm_radius_udp_t, dst_ipaddr) },
+
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, rlm_radius_udp_t, dst_port) },
+
+	{ FR_CONF_OFFSET("src_ipaddr", FR_TYPE_COMBO_IP_ADDR, rlm_radius_udp_t, src_ipaddr) },
+	{ FR_CONF_OFFSET("src_ipv4addr", FR_TYPE_IPV4_ADDR, rlm_radius_udp_t, src_ipaddr) },
+	{ FR_CONF_OFFSET("src_ipv6addr", FR_TYPE_IPV6_ADDR, rlm_radius_udp_t, src_ipaddr) },
+
+	{ FR_CONF_IS_SET_OFFSET("recv_buff", FR_TYPE_UINT32, rlm_radius_udp_t, recv_buff) },
+
+	CONF_PARSER_TERMINATOR
+};
+
+/** Open a connected UDP socket
+ *
+ * The kernel picks a new source port for every socket.
+ */
+static fr_connection_state_t mod_init(int *fd_out, void *io_ctx, void const *io_instance)
+{
+	rlm_radius_udp_t const		*inst = talloc_get_type_abort(io_instance, rlm_radius_udp_t);
+	rlm_radius_udp_connection_t	*conn = io_ctx;
+	int				fd;
+
+	conn->inst = inst;
+	conn->fd = -1;
+
+	fd = fr_socket_client_udp(&inst->src_ipaddr, &inst->dst_ipaddr, inst->dst_port, true);
+	if (fd < 0) {
+		PERROR("Failed opening UDP socket");
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+#ifdef SO_RCVBUF
+	if (inst->recv_buff_is_set) {
+		int opt = inst->recv_buff;
+
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(int)) < 0) {
+			WARN("Failed setting 'recv_buf': %s", fr_syserror(errno));
+		}
+	}
+#endif
+
+	conn->fd = fd;
+	*fd_out = fd;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+/** Close the socket
+ *
+ */
+static void mod_close(int fd, void *io_ctx)
+{
+	rlm_radius_udp_connection_t *conn = io_ctx;
+
+	if (fd >= 0) close(fd);
+	conn->fd = -1;
+}
+
+/** Print the local and remote addresses of the socket
+ *
+ */
+static char *mod_get_name(TALLOC_CTX *ctx, void *io_ctx)
+{
+	rlm_radius_udp_connection_t	*conn = io_ctx;
+	rlm_radius_udp_t const		*inst = conn->inst;
+	struct sockaddr_storage		salocal;
+	socklen_t			salen = sizeof(salocal);
+	fr_ipaddr_t			src_ipaddr;
+	uint16_t			src_port = 0;
+	char				src_buf[FR_IPADDR_STRLEN], dst_buf[FR_IPADDR_STRLEN];
+
+	memset(&src_ipaddr, 0, sizeof(src_ipaddr));
+	if ((getsockname(conn->fd, (struct sockaddr *) &salocal, &salen) < 0) ||
+	    (fr_ipaddr_from_sockaddr(&salocal, salen, &src_ipaddr, &src_port) < 0)) {
+		src_ipaddr = inst->src_ipaddr;
+	}
+
+	return talloc_typed_asprintf(ctx, "proto udp local %s port %u remote %s port %u",
+				     fr_inet_ntop(src_buf, sizeof(src_buf), &src_ipaddr), src_port,
+				     fr_inet_ntop(dst_buf, sizeof(dst_buf), &inst->dst_ipaddr), inst->dst_port);
+}
+
+/** Write one packet to the socket
+ *
+ */
+static ssize_t mod_write(int fd, UNUSED void *io_ctx, uint8_t const *packet, size_t packet_len)
+{
+	ssize_t rcode;
+
+	rcode = write(fd, packet, packet_len);
+	if (rcode >= 0) return rcode;
+
+	if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) return 0;
+
+	fr_strerror_printf("%s", fr_syserror(errno));
+	return -1;
+}
+
+/** Read one packet from the socket
+ *
+ */
+static ssize_t mod_read(int fd, UNUSED void *io_ctx, uint8_t *buffer, size_t buffer_len)
+{
+	ssize_t rcode;
+
+	rcode = read(fd, buffer, buffer_len);
+	if (rcode > 0) return rcode;
+
+	if (rcode == 0) return 0;
+
+	if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) return 0;
+
+	/*
+	 *	The home server isn't listening.  Its ICMP errors
+	 *	don't mean that our socket has failed.
+	 */
+	if (errno == ECONNREFUSED) return 0;
+
+	fr_strerror_printf("%s", fr_syserror(errno));
+	return -1;
+}
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+/** Write many packets to the socket, with one system call
+ *
+ * The socket is connected, so the packets don't need addresses.
+ */
+static int mod_write_batch(int fd, UNUSED void *io_ctx, struct iovec *packets, int num)
+{
+	struct mmsghdr	msgs[num];
+	int		i, rcode;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < num; i++) {
+		msgs[i].msg_hdr.msg_iov = &packets[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	rcode = sendmmsg(fd, msgs, num, 0);
+	if (rcode >= 0) return rcode;
+
+	if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) return 0;
+
+	fr_strerror_printf("%s", fr_syserror(errno));
+	return -1;
+}
+
+/** Read as many packets as are available, with one system call
+ *
+ */
+static int mod_read_batch(int fd, UNUSED void *io_ctx, struct iovec *buffers, int num)
+{
+	struct mmsghdr	msgs[num];
+	int		i, rcode;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < num; i++) {
+		msgs[i].msg_hdr.msg_iov = &buffers[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	rcode = recvmmsg(fd, msgs, num, MSG_DONTWAIT, NULL);
+	if (rcode < 0) {
+		if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) return 0;
+
+		if (errno == ECONNREFUSED) return 0;
+
+		fr_strerror_printf("%s", fr_syserror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < rcode; i++) buffers[i].iov_len = msgs[i].msg_len;
+
+	return rcode;
+}
+#endif
+
+static int mod_bootstrap(void *instance, CONF_SECTION *cs)
+{
+	rlm_radius_udp_t	*inst = talloc_get_type_abort(instance, rlm_radius_udp_t);
+
+	if (inst->dst_ipaddr.af == AF_UNSPEC) {
+		cf_log_err(cs, "No 'ipaddr' was specified in the 'udp' section");
+		return -1;
+	}
+
+	if (!inst->dst_port) {
+		cf_log_err(cs, "No 'port' was specified in the 'udp' section");
+		return -1;
+	}
+
+	/*
+	 *	Bind to the same address family as the home server.
+	 */
+	if (inst->src_ipaddr.af == AF_UNSPEC) {
+		memset(&inst->src_ipaddr, 0, sizeof(inst->src_ipaddr));
+		inst->src_ipaddr.af = inst->dst_ipaddr.af;
+		inst->src_ipaddr.prefix = (inst->dst_ipaddr.af == AF_INET) ? 32 : 128;
+	}
+
+	if (inst->src_ipaddr.af != inst->dst_ipaddr.af) {
+		cf_log_err(cs, "The 'src_ipaddr' and 'ipaddr' must be of the same address family");
+		return -1;
+	}
+
+	if (inst->recv_buff_is_set) {
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, >=, 32);
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, <=, INT_MAX);
+	}
+
+	return 0;
+}
+
+extern fr_radius_client_io_t rlm_radius_udp;
+fr_radius_client_io_t rlm_radius_udp = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "radius_udp",
+	.inst_size	= sizeof(rlm_radius_udp_t),
+	.config		= module_config,
+	.bootstrap	= mod_bootstrap,
+
+	.io_inst_size	= sizeof(rlm_radius_udp_connection_t),
+
+	.init		= mod_init,
+	.close		= mod_close,
+	.get_name	= mod_get_name,
+	.write		= mod_write,
+	.read		= mod_read,
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+	.write_batch	= mod_write_batch,
+	.read_batch	= mod_read_batch,
+#endif
+};
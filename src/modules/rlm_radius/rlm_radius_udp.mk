@@ -0,0 +1,9 @@
+TARGETNAME	:= rlm_radius_udp
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME).a
+endif
+
+SOURCES		:= rlm_radius_udp.c
+
+TGT_PREREQS	:= libfreeradius-util.a
@@ -0,0 +1,622 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file spool.c
+ * @brief Local spool of packets which couldn't be proxied.
+ *
+ * The spool is a directory of segment files, each of which is mapped
+ * into memory.  Packets are appended to the newest segment, and
+ * replayed from the oldest.  A segment is removed once all of its
+ * packets have been acknowledged.
+ *
+ * Each segment starts with a header, in native byte order, as the
+ * spool is only read by the server which wrote it:
+ *
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |                        Magic ("FRsp")                         |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |                            Version                            |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |                   Size of the file (64 bits)                  |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |               End of the last record (64 bits)                |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |          End of the last acknowledged record (64 bits)        |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ * Each record is:
+ *
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |                         Packet length                         |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |                           Reserved                            |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |                When it was written (64 bits)                  |
+ *	 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	 |  The packet in wire format, padded to a multiple of 8 bytes ...
+ *	 +-+-+-+-+-+-+-+-+-
+ *
+ * A record is written before the header says it's there, so a crash
+ * part way through writing one loses only that record, which the
+ * caller hasn't yet been told was spooled.  The acknowledged offset
+ * only moves forward once the home server has replied, so packets
+ * are delivered at least once.
+ *
+ * Segment files are written out in full when they're created, so
+ * that running out of disk space is an error when the segment is
+ * created, and not a SIGBUS when a packet is written to it.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/io/time.h>
+#include <freeradius-devel/net.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#include "spool.h"
+
+#define RADIUS_SPOOL_MAGIC		(0x46527370)	/* "FRsp" */
+#define RADIUS_SPOOL_VERSION		(1)
+#define RADIUS_SPOOL_SUFFIX		".spool"
+#define RADIUS_SPOOL_ALIGN(_x)		(((_x) + 7) & ~((size_t)7))
+
+typedef struct {
+	uint32_t		magic;
+	uint32_t		version;
+	uint64_t		size;
+	uint64_t		used;
+	uint64_t		acked;
+} radius_spool_header_t;
+
+typedef struct {
+	uint32_t		packet_len;
+	uint32_t		reserved;
+	uint64_t		when;
+	uint8_t			packet[];
+} radius_spool_record_t;
+
+#define RADIUS_SPOOL_HDR_LEN		RADIUS_SPOOL_ALIGN(sizeof(radius_spool_header_t))
+#define RADIUS_SPOOL_RECORD_LEN(_len)	RADIUS_SPOOL_ALIGN(sizeof(radius_spool_record_t) + (_len))
+
+/** One file in the spool
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< In the spool's list, oldest first.
+	uint64_t		seq;		//!< Sequence number, which is also the file name.
+	char			*filename;
+	int			fd;
+	uint8_t			*base;		//!< Where the file is mapped.
+	size_t			size;		//!< Of the file.
+	radius_spool_header_t	*header;	//!< At the start of the mapping.
+} radius_spool_segment_t;
+
+struct radius_spool {
+	pthread_mutex_t		mutex;		//!< Protects everything below.
+
+	char const		*directory;
+	size_t			segment_size;	//!< Of new segments.
+	uint64_t		max_size;	//!< Most disk space all of the segments may use.
+	bool			sync;		//!< Write to disk before saying a packet was spooled.
+
+	fr_dlist_t		segments;	//!< Oldest first.  Packets are written to the last one.
+	uint32_t		num_segments;
+	uint64_t		next_seq;	//!< For the next segment we create.
+
+	uint64_t		records;	//!< Written, and not yet acknowledged.
+	uint64_t		bytes;		//!< Of those packets.
+};
+
+/** Write part of a segment to disk
+ *
+ */
+static void spool_sync(radius_spool_t *spool, radius_spool_segment_t *seg, size_t offset, size_t len)
+{
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t start = offset & ~(page - 1);
+
+	if (!spool->sync) return;
+
+	if (msync(seg->base + start, (offset - start) + len, MS_SYNC) < 0) {
+		ERROR("Failed syncing %s: %s", seg->filename, fr_syserror(errno));
+	}
+}
+
+static int _spool_segment_free(radius_spool_segment_t *seg)
+{
+	if (seg->base) munmap(seg->base, seg->size);
+	if (seg->fd >= 0) close(seg->fd);
+
+	return 0;
+}
+
+/** Map a segment file
+ *
+ * @param[in] spool	the segment is in.
+ * @param[in] seq	of the segment.
+ * @param[in] create	a new, empty segment.
+ * @return
+ *	- The segment.
+ *	- NULL on error.
+ */
+static radius_spool_segment_t *spool_segment_open(radius_spool_t *spool, uint64_t seq, bool create)
+{
+	radius_spool_segment_t	*seg;
+	struct stat		st;
+
+	MEM(seg = talloc_zero(spool, radius_spool_segment_t));
+	seg->seq = seq;
+	seg->fd = -1;
+	seg->filename = talloc_typed_asprintf(seg, "%s/%016" PRIx64 RADIUS_SPOOL_SUFFIX, spool->directory, seq);
+	talloc_set_destructor(seg, _spool_segment_free);
+
+	if (create) {
+		uint8_t	zero[8192];
+		size_t	done;
+
+		seg->fd = open(seg->filename, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (seg->fd < 0) goto error;
+
+		memset(zero, 0, sizeof(zero));
+		for (done = 0; done < spool->segment_size; done += sizeof(zero)) {
+			size_t len = spool->segment_size - done;
+
+			if (len > sizeof(zero)) len = sizeof(zero);
+
+			if (write(seg->fd, zero, len) != (ssize_t) len) {
+				int error = errno;
+
+				unlink(seg->filename);
+				errno = error;
+				goto error;
+			}
+		}
+		seg->size = spool->segment_size;
+
+	} else {
+		seg->fd = open(seg->filename, O_RDWR);
+		if (seg->fd < 0) goto error;
+
+		if (fstat(seg->fd, &st) < 0) goto error;
+
+		if ((size_t) st.st_size < RADIUS_SPOOL_HDR_LEN) {
+			fr_strerror_printf("%s is too small to be a spool segment", seg->filename);
+			talloc_free(seg);
+			return NULL;
+		}
+		seg->size = st.st_size;
+	}
+
+	seg->base = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+	if (seg->base == MAP_FAILED) {
+		seg->base = NULL;
+	error:
+		fr_strerror_printf("Failed opening %s: %s", seg->filename, fr_syserror(errno));
+		talloc_free(seg);
+		return NULL;
+	}
+	seg->header = (radius_spool_header_t *) seg->base;
+
+	/*
+	 *	A segment which is all zeros was being created when
+	 *	the server stopped.  It's empty.
+	 */
+	if (create || !seg->header->magic) {
+		seg->header->magic = RADIUS_SPOOL_MAGIC;
+		seg->header->version = RADIUS_SPOOL_VERSION;
+		seg->header->size = seg->size;
+		seg->header->used = RADIUS_SPOOL_HDR_LEN;
+		seg->header->acked = RADIUS_SPOOL_HDR_LEN;
+		spool_sync(spool, seg, 0, RADIUS_SPOOL_HDR_LEN);
+		return seg;
+	}
+
+	if ((seg->header->magic != RADIUS_SPOOL_MAGIC) || (seg->header->version != RADIUS_SPOOL_VERSION) ||
+	    (seg->header->size != seg->size) ||
+	    (seg->header->used < RADIUS_SPOOL_HDR_LEN) || (seg->header->used > seg->size) ||
+	    (seg->header->acked < RADIUS_SPOOL_HDR_LEN) || (seg->header->acked > seg->header->used)) {
+		fr_strerror_printf("%s is not a valid spool segment", seg->filename);
+		talloc_free(seg);
+		return NULL;
+	}
+
+	return seg;
+}
+
+/** Remove a segment whose packets have all been acknowledged
+ *
+ */
+static void spool_segment_remove(radius_spool_t *spool, radius_spool_segment_t *seg)
+{
+	fr_dlist_remove(&seg->entry);
+	spool->num_segments--;
+
+	if (unlink(seg->filename) < 0) ERROR("Failed removing %s: %s", seg->filename, fr_syserror(errno));
+
+	talloc_free(seg);
+}
+
+/** Walk the records between two offsets of a segment
+ *
+ * @return the number of records, or -1 if one of them is invalid.
+ */
+static int64_t spool_segment_count(radius_spool_segment_t *seg, uint64_t start, uint64_t end, uint64_t *bytes)
+{
+	int64_t			count = 0;
+	radius_spool_record_t	*record;
+
+	while (start < end) {
+		if ((start + sizeof(*record)) > end) return -1;
+
+		record = (radius_spool_record_t *) (seg->base + start);
+		if ((record->packet_len < RADIUS_HDR_LEN) || (record->packet_len > MAX_PACKET_LEN) ||
+		    ((start + RADIUS_SPOOL_RECORD_LEN(record->packet_len)) > end)) return -1;
+
+		*bytes += record->packet_len;
+		start += RADIUS_SPOOL_RECORD_LEN(record->packet_len);
+		count++;
+	}
+
+	return count;
+}
+
+static int spool_seq_cmp(void const *one, void const *two)
+{
+	uint64_t const *a = one, *b = two;
+
+	return (*a > *b) - (*a < *b);
+}
+
+static int _spool_free(radius_spool_t *spool)
+{
+	pthread_mutex_destroy(&spool->mutex);
+
+	return 0;
+}
+
+/** Open a spool, and find the packets which haven't been replayed
+ *
+ * @param[in] ctx		to allocate the spool in.
+ * @param[in] directory		for the segment files.  It's created if it doesn't exist.
+ * @param[in] segment_size	of new segment files.
+ * @param[in] max_size		most disk space the segment files may use.
+ * @param[in] sync		write each packet to disk before returning.
+ * @return
+ *	- The spool.
+ *	- NULL on error.
+ */
+radius_spool_t *radius_spool_open(TALLOC_CTX *ctx, char const *directory, size_t segment_size,
+				  uint64_t max_size, bool sync)
+{
+	radius_spool_t		*spool;
+	DIR			*dir;
+	struct dirent		*dp;
+	uint64_t		*seqs = NULL;
+	size_t			num_seqs = 0, i;
+	char			*p;
+
+	MEM(spool = talloc_zero(ctx, radius_spool_t));
+	spool->directory = talloc_typed_strdup(spool, directory);
+	spool->segment_size = segment_size;
+	spool->max_size = max_size;
+	spool->sync = sync;
+	spool->next_seq = 1;
+	FR_DLIST_INIT(spool->segments);
+
+	pthread_mutex_init(&spool->mutex, NULL);
+	talloc_set_destructor(spool, _spool_free);
+
+	memcpy(&p, &spool->directory, sizeof(p)); /* const issues */
+	if (rad_mkdir(p, 0700, -1, -1) < 0) {
+		fr_strerror_printf("Failed creating %s: %s", directory, fr_syserror(errno));
+	error:
+		talloc_free(seqs);
+		talloc_free(spool);
+		return NULL;
+	}
+
+	dir = opendir(directory);
+	if (!dir) {
+		fr_strerror_printf("Failed opening %s: %s", directory, fr_syserror(errno));
+		goto error;
+	}
+
+	while ((dp = readdir(dir)) != NULL) {
+		uint64_t seq;
+
+		seq = strtoull(dp->d_name, &p, 16);
+		if ((p != dp->d_name + 16) || (strcmp(p, RADIUS_SPOOL_SUFFIX) != 0) || !seq) continue;
+
+		seqs = talloc_realloc(spool, seqs, uint64_t, num_seqs + 1);
+		seqs[num_seqs++] = seq;
+	}
+	closedir(dir);
+
+	if (num_seqs) qsort(seqs, num_seqs, sizeof(*seqs), spool_seq_cmp);
+
+	for (i = 0; i < num_seqs; i++) {
+		radius_spool_segment_t	*seg;
+		int64_t			count;
+		uint64_t		bytes = 0;
+
+		seg = spool_segment_open(spool, seqs[i], false);
+		if (!seg) goto error;
+
+		/*
+		 *	Stop at the first record which doesn't make
+		 *	sense.  Nothing after it can be trusted.
+		 */
+		count = spool_segment_count(seg, seg->header->acked, seg->header->used, &bytes);
+		if (count < 0) {
+			fr_strerror_printf("%s has invalid records", seg->filename);
+			talloc_free(seg);
+			goto error;
+		}
+
+		fr_dlist_insert_tail(&spool->segments, &seg->entry);
+		spool->num_segments++;
+		spool->records += count;
+		spool->bytes += bytes;
+		spool->next_seq = seg->seq + 1;
+	}
+	talloc_free(seqs);
+
+	if (spool->records) {
+		INFO("Spool %s has %" PRIu64 " packets to replay", directory, spool->records);
+	}
+
+	return spool;
+}
+
+/** Add a packet to the spool
+ *
+ * @return
+ *	- 0 once the packet is in the spool.
+ *	- -1 on error, or if the spool is full.
+ */
+int radius_spool_write(radius_spool_t *spool, uint8_t const *packet, size_t packet_len)
+{
+	fr_dlist_t		*entry;
+	radius_spool_segment_t	*seg = NULL;
+	radius_spool_record_t	*record;
+	size_t			len = RADIUS_SPOOL_RECORD_LEN(packet_len);
+	uint64_t		offset;
+
+	if ((packet_len < RADIUS_HDR_LEN) || (packet_len > MAX_PACKET_LEN)) {
+		fr_strerror_printf("Invalid packet length %zu", packet_len);
+		return -1;
+	}
+
+	pthread_mutex_lock(&spool->mutex);
+
+	entry = FR_DLIST_TAIL(spool->segments);
+	if (entry) seg = fr_ptr_to_type(radius_spool_segment_t, entry, entry);
+
+	if (!seg || ((seg->header->used + len) > seg->size)) {
+		radius_spool_segment_t *old = seg;
+
+		if (((uint64_t) (spool->num_segments + 1) * spool->segment_size) > spool->max_size) {
+			pthread_mutex_unlock(&spool->mutex);
+			fr_strerror_printf("Spool %s is full", spool->directory);
+			return -1;
+		}
+
+		seg = spool_segment_open(spool, spool->next_seq, true);
+		if (!seg) {
+			pthread_mutex_unlock(&spool->mutex);
+			return -1;
+		}
+		spool->next_seq++;
+
+		fr_dlist_insert_tail(&spool->segments, &seg->entry);
+		spool->num_segments++;
+
+		/*
+		 *	The old segment was only kept because we were
+		 *	still writing to it.
+		 */
+		if (old && (old->header->acked == old->header->used)) spool_segment_remove(spool, old);
+	}
+
+	offset = seg->header->used;
+	record = (radius_spool_record_t *) (seg->base + offset);
+	record->packet_len = packet_len;
+	record->reserved = 0;
+	record->when = time(NULL);
+	memcpy(record->packet, packet, packet_len);
+	spool_sync(spool, seg, offset, len);
+
+	/*
+	 *	The record has to be complete before the header says
+	 *	it's there.
+	 */
+	atomic_thread_fence(memory_order_release);
+	seg->header->used = offset + len;
+	spool_sync(spool, seg, 0, RADIUS_SPOOL_HDR_LEN);
+
+	spool->records++;
+	spool->bytes += packet_len;
+
+	pthread_mutex_unlock(&spool->mutex);
+
+	return 0;
+}
+
+/** Find the first packet which hasn't been acknowledged
+ *
+ */
+void radius_spool_start(radius_spool_t *spool, radius_spool_pos_t *pos)
+{
+	fr_dlist_t		*entry;
+	radius_spool_segment_t	*seg;
+
+	pthread_mutex_lock(&spool->mutex);
+
+	entry = FR_DLIST_FIRST(spool->segments);
+	if (!entry) {
+		pos->seq = spool->next_seq;
+		pos->offset = RADIUS_SPOOL_HDR_LEN;
+	} else {
+		seg = fr_ptr_to_type(radius_spool_segment_t, entry, entry);
+		pos->seq = seg->seq;
+		pos->offset = seg->header->acked;
+	}
+
+	pthread_mutex_unlock(&spool->mutex);
+}
+
+/** Read the packet at a position, and move the position to the next one
+ *
+ * The packet stays where it is until it's acknowledged, so the caller
+ * can use it until then.
+ *
+ * @return
+ *	- 1 if there was a packet.
+ *	- 0 if there are no more packets.
+ */
+int radius_spool_read(radius_spool_t *spool, radius_spool_pos_t *pos,
+		      uint8_t const **packet, size_t *packet_len, time_t *when)
+{
+	fr_dlist_t		*entry;
+	radius_spool_segment_t	*seg = NULL;
+	radius_spool_record_t	*record;
+
+	pthread_mutex_lock(&spool->mutex);
+
+	for (entry = FR_DLIST_FIRST(spool->segments);
+	     entry != NULL;
+	     entry = FR_DLIST_NEXT(spool->segments, entry)) {
+		seg = fr_ptr_to_type(radius_spool_segment_t, entry, entry);
+
+		if (seg->seq < pos->seq) continue;
+
+		if (seg->seq > pos->seq) {
+			pos->seq = seg->seq;
+			pos->offset = seg->header->acked;
+		}
+
+		if (pos->offset < seg->header->used) break;
+	}
+
+	if (!entry) {
+		pthread_mutex_unlock(&spool->mutex);
+		return 0;
+	}
+
+	record = (radius_spool_record_t *) (seg->base + pos->offset);
+	*packet = record->packet;
+	*packet_len = record->packet_len;
+	*when = record->when;
+
+	pos->offset += RADIUS_SPOOL_RECORD_LEN(record->packet_len);
+
+	pthread_mutex_unlock(&spool->mutex);
+
+	return 1;
+}
+
+/** Mark every packet before a position as delivered
+ *
+ * Segments which have been completely delivered are removed.
+ */
+void radius_spool_ack(radius_spool_t *spool, radius_spool_pos_t const *pos)
+{
+	fr_dlist_t		*entry, *next;
+	radius_spool_segment_t	*seg;
+	uint64_t		end, bytes;
+	int64_t			count;
+
+	pthread_mutex_lock(&spool->mutex);
+
+	while ((entry = FR_DLIST_FIRST(spool->segments)) != NULL) {
+		seg = fr_ptr_to_type(radius_spool_segment_t, entry, entry);
+		if (seg->seq > pos->seq) break;
+
+		end = (seg->seq < pos->seq) ? seg->header->used : pos->offset;
+		if (end > seg->header->used) end = seg->header->used;
+
+		if (end > seg->header->acked) {
+			bytes = 0;
+			count = spool_segment_count(seg, seg->header->acked, end, &bytes);
+			if (count > 0) {
+				spool->records -= count;
+				spool->bytes -= bytes;
+			}
+
+			seg->header->acked = end;
+			spool_sync(spool, seg, 0, RADIUS_SPOOL_HDR_LEN);
+		}
+
+		/*
+		 *	Packets are still being written to the last
+		 *	segment, so it stays.
+		 */
+		if (seg->header->acked < seg->header->used) break;
+
+		next = FR_DLIST_NEXT(spool->segments, entry);
+		if (!next) break;
+
+		spool_segment_remove(spool, seg);
+	}
+
+	pthread_mutex_unlock(&spool->mutex);
+}
+
+/** Say how much is waiting to be replayed
+ *
+ */
+void radius_spool_stats(radius_spool_t *spool, radius_spool_stats_t *stats)
+{
+	fr_dlist_t		*entry;
+	radius_spool_segment_t	*seg;
+	radius_spool_record_t	*record;
+
+	memset(stats, 0, sizeof(*stats));
+
+	pthread_mutex_lock(&spool->mutex);
+
+	stats->records = spool->records;
+	stats->bytes = spool->bytes;
+
+	for (entry = FR_DLIST_FIRST(spool->segments);
+	     entry != NULL;
+	     entry = FR_DLIST_NEXT(spool->segments, entry)) {
+		seg = fr_ptr_to_type(radius_spool_segment_t, entry, entry);
+
+		if (seg->header->acked == seg->header->used) continue;
+
+		record = (radius_spool_record_t *) (seg->base + seg->header->acked);
+		stats->oldest = record->when;
+		break;
+	}
+
+	pthread_mutex_unlock(&spool->mutex);
+}
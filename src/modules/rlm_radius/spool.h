@@ -0,0 +1,52 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ * @file spool.h
+ * @brief Local spool of packets which couldn't be proxied.
+ *
+ * @copyright 2026  The FreeRADIUS server project
+ */
+RCSIDH(spool_h, "$Id$")
+
+typedef struct radius_spool radius_spool_t;
+
+/** Where a record is in the spool
+ *
+ */
+typedef struct {
+	uint64_t		seq;		//!< Of the segment.
+	uint64_t		offset;		//!< Of the record in the segment.
+} radius_spool_pos_t;
+
+/** How much is waiting to be replayed
+ *
+ */
+typedef struct {
+	uint64_t		records;	//!< Written, and not yet acknowledged.
+	uint64_t		bytes;		//!< Of those packets.
+	time_t			oldest;		//!< When the oldest of them was written, or 0.
+} radius_spool_stats_t;
+
+radius_spool_t *radius_spool_open(TALLOC_CTX *ctx, char const *directory, size_t segment_size,
+				  uint64_t max_size, bool sync);
+int radius_spool_write(radius_spool_t *spool, uint8_t const *packet, size_t packet_len);
+void radius_spool_start(radius_spool_t *spool, radius_spool_pos_t *pos);
+int radius_spool_read(radius_spool_t *spool, radius_spool_pos_t *pos,
+		      uint8_t const **packet, size_t *packet_len, time_t *when);
+void radius_spool_ack(radius_spool_t *spool, radius_spool_pos_t const *pos);
+void radius_spool_stats(radius_spool_t *spool, radius_spool_stats_t *stats);
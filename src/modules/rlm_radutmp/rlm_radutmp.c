@@ -19,6 +19,14 @@
  * @file rlm_radutmp.c
  * @brief Tracks sessions.
  *
+ * The sessions are kept in memory, in two tables.  One is keyed by NAS
+ * and port, and the other counts the sessions of each user.  Each table
+ * is split into shards with their own lock, so that accounting packets
+ * for different ports don't wait for each other.
+ *
+ * A thread writes the sessions to the radutmp file every
+ * "snapshot_interval", for radwho, and so that they survive a restart.
+ *
  * @copyright 2000-2013  The FreeRADIUS server project
  */
 RCSID("$Id$")
@@ -28,32 +36,68 @@ RCSID("$Id$")
 #include	<freeradius-devel/modules.h>
 #include	<freeradius-devel/rad_assert.h>
 
+#include	<ctype.h>
 #include	<fcntl.h>
+#include	<pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include	<stdatomic.h>
+#else
+#  include	<freeradius-devel/stdatomic.h>
+#endif
 
 #include "config.h"
 
-#define LOCK_LEN sizeof(struct radutmp)
+#define RADUTMP_NUM_SHARDS	64	//!< Must be a power of 2.
+#define RADUTMP_SHARD_SHIFT	26	//!< Shards use the top bits of the hash, the tables use the bottom ones.
 
 static char const porttypes[] = "ASITX";
 
-/*
- *	used for caching radutmp lookups in the accounting component.
+/** One table, or part of one
+ *
+ */
+typedef struct {
+	pthread_mutex_t		mutex;
+	fr_hash_table_t		*ht;		//!< Entries are allocated in the table.
+} radutmp_shard_t;
+
+/** How many sessions a user has
+ *
+ */
+typedef struct {
+	char			login[RUT_NAMESIZE + 1];	//!< Folded to lower case if we're not case sensitive.
+	uint32_t		sessions;
+} radutmp_user_t;
+
+/** All of the sessions
+ *
+ * Allocated outside of the module instance, as it changes after the
+ * instance has been made read-only.
  */
-typedef struct nas_port {
-	uint32_t		nasaddr;
-	uint16_t		port;
-	off_t			offset;
-	struct nas_port 	*next;
-} NAS_PORT;
+typedef struct {
+	radutmp_shard_t		ports[RADUTMP_NUM_SHARDS];	//!< struct radutmp, keyed by NAS and port.
+	radutmp_shard_t		users[RADUTMP_NUM_SHARDS];	//!< radutmp_user_t, keyed by login.
+
+	_Atomic(bool)		dirty;		//!< Sessions have changed since the last snapshot.
+
+	pthread_mutex_t		mutex;		//!< Protects "stop".
+	pthread_cond_t		cond;		//!< Wakes the snapshot thread when we stop.
+	bool			stop;
+	bool			running;	//!< There's a snapshot thread.
+	pthread_t		thread;
+} radutmp_table_t;
 
 typedef struct rlm_radutmp_t {
-	NAS_PORT	*nas_port_list;
+	char const	*name;
 	char const	*filename;
 	char const	*username;
 	bool		case_sensitive;
 	bool		check_nas;
 	uint32_t	permission;
 	bool		caller_id_ok;
+	struct timeval	snapshot_interval;
+
+	radutmp_table_t	*table;
 } rlm_radutmp_t;
 
 static const CONF_PARSER module_config[] = {
@@ -63,104 +107,554 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("check_with_nas", FR_TYPE_BOOL, rlm_radutmp_t, check_nas), .dflt = "yes" },
 	{ FR_CONF_OFFSET("permissions", FR_TYPE_UINT32, rlm_radutmp_t, permission), .dflt = "0644" },
 	{ FR_CONF_OFFSET("caller_id", FR_TYPE_BOOL, rlm_radutmp_t, caller_id_ok), .dflt = "no" },
+	{ FR_CONF_OFFSET("snapshot_interval", FR_TYPE_TIMEVAL, rlm_radutmp_t, snapshot_interval), .dflt = "5" },
 	CONF_PARSER_TERMINATOR
 };
 
+static uint32_t radutmp_port_hash(void const *data)
+{
+	struct radutmp const *u = data;
+	uint32_t hash;
+
+	hash = fr_hash(&u->nas_address, sizeof(u->nas_address));
+	return fr_hash_update(&u->nas_port, sizeof(u->nas_port), hash);
+}
+
+static int radutmp_port_cmp(void const *one, void const *two)
+{
+	struct radutmp const *a = one;
+	struct radutmp const *b = two;
+
+	if (a->nas_address != b->nas_address) return (a->nas_address < b->nas_address) ? -1 : 1;
+
+	return (a->nas_port > b->nas_port) - (a->nas_port < b->nas_port);
+}
+
+static uint32_t radutmp_user_hash(void const *data)
+{
+	return fr_hash_string(((radutmp_user_t const *)data)->login);
+}
+
+static int radutmp_user_cmp(void const *one, void const *two)
+{
+	return strcmp(((radutmp_user_t const *)one)->login, ((radutmp_user_t const *)two)->login);
+}
+
+/** Make the key we count a user's sessions by
+ *
+ * The login in a radutmp entry isn't always '\\0' terminated.
+ */
+static void radutmp_user_key(rlm_radutmp_t const *inst, char out[RUT_NAMESIZE + 1], char const *login)
+{
+	size_t i;
+
+	for (i = 0; (i < RUT_NAMESIZE) && login[i]; i++) {
+		out[i] = inst->case_sensitive ? login[i] : tolower((uint8_t) login[i]);
+	}
+	out[i] = '\0';
+}
+
+static radutmp_shard_t *radutmp_port_shard(radutmp_table_t *table, struct radutmp const *u)
+{
+	return &table->ports[(radutmp_port_hash(u) >> RADUTMP_SHARD_SHIFT) & (RADUTMP_NUM_SHARDS - 1)];
+}
+
+static radutmp_shard_t *radutmp_user_shard(radutmp_table_t *table, radutmp_user_t const *user)
+{
+	return &table->users[(radutmp_user_hash(user) >> RADUTMP_SHARD_SHIFT) & (RADUTMP_NUM_SHARDS - 1)];
+}
+
+/** Add one to the sessions of a user
+ *
+ */
+static void radutmp_user_add(rlm_radutmp_t const *inst, char const *login)
+{
+	radutmp_shard_t		*shard;
+	radutmp_user_t		my_user, *user;
+
+	radutmp_user_key(inst, my_user.login, login);
+	shard = radutmp_user_shard(inst->table, &my_user);
+
+	pthread_mutex_lock(&shard->mutex);
+	user = fr_hash_table_finddata(shard->ht, &my_user);
+	if (!user) {
+		MEM(user = talloc_zero(shard->ht, radutmp_user_t));
+		strlcpy(user->login, my_user.login, sizeof(user->login));
+		if (!fr_hash_table_insert(shard->ht, user)) {
+			talloc_free(user);
+			pthread_mutex_unlock(&shard->mutex);
+			return;
+		}
+	}
+	user->sessions++;
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/** Take one from the sessions of a user
+ *
+ */
+static void radutmp_user_del(rlm_radutmp_t const *inst, char const *login)
+{
+	radutmp_shard_t		*shard;
+	radutmp_user_t		my_user, *user;
+
+	radutmp_user_key(inst, my_user.login, login);
+	shard = radutmp_user_shard(inst->table, &my_user);
+
+	pthread_mutex_lock(&shard->mutex);
+	user = fr_hash_table_finddata(shard->ht, &my_user);
+	if (user && (--user->sessions == 0)) {
+		(void) fr_hash_table_yank(shard->ht, user);
+		talloc_free(user);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/** Return how many sessions a user has
+ *
+ */
+static uint32_t radutmp_user_count(rlm_radutmp_t const *inst, char const *login)
+{
+	radutmp_shard_t		*shard;
+	radutmp_user_t		my_user, *user;
+	uint32_t		sessions = 0;
+
+	radutmp_user_key(inst, my_user.login, login);
+	shard = radutmp_user_shard(inst->table, &my_user);
+
+	pthread_mutex_lock(&shard->mutex);
+	user = fr_hash_table_finddata(shard->ht, &my_user);
+	if (user) sessions = user->sessions;
+	pthread_mutex_unlock(&shard->mutex);
+
+	return sessions;
+}
+
+/** Add a session, replacing any other session on the same NAS and port
+ *
+ * The port shard must be locked.
+ */
+static int radutmp_session_insert(rlm_radutmp_t const *inst, radutmp_shard_t *shard, struct radutmp const *ut)
+{
+	struct radutmp *u;
+
+	u = fr_hash_table_finddata(shard->ht, ut);
+	if (u) {
+		radutmp_user_del(inst, u->login);
+	} else {
+		u = talloc(shard->ht, struct radutmp);
+		if (!u) return -1;
+
+		*u = *ut;
+		if (!fr_hash_table_insert(shard->ht, u)) {
+			talloc_free(u);
+			return -1;
+		}
+	}
+
+	*u = *ut;
+	u->type = P_LOGIN;
+	radutmp_user_add(inst, u->login);
+
+	atomic_store(&inst->table->dirty, true);
+
+	return 0;
+}
 
-#ifdef WITH_ACCOUNTING
 /*
- *	Zap all users on a NAS from the radutmp file.
+ *	Used for finding, or copying, every session.
  */
-static rlm_rcode_t radutmp_zap(REQUEST *request, char const *filename, uint32_t nasaddr, time_t t)
+typedef struct {
+	uint32_t	nas_address;	//!< Only sessions on this NAS, or any NAS if 0.
+	struct radutmp	**found;
+	struct radutmp	*copy;
+	size_t		num;
+} radutmp_walk_t;
+
+static int _radutmp_find_nas(void *ctx, void *data)
 {
-	struct radutmp	u;
-	int		fd;
+	radutmp_walk_t	*walk = ctx;
+	struct radutmp	*u = data;
 
-	if (t == 0) time(&t);
+	if (walk->nas_address && (u->nas_address != walk->nas_address)) return 0;
 
-	fd = open(filename, O_RDWR);
-	if (fd < 0) {
-		REDEBUG("Error accessing file %s: %s", filename, fr_syserror(errno));
-		return RLM_MODULE_FAIL;
+	MEM(walk->found = talloc_realloc(NULL, walk->found, struct radutmp *, walk->num + 1));
+	walk->found[walk->num++] = u;
+
+	return 0;
+}
+
+static int _radutmp_copy(void *ctx, void *data)
+{
+	radutmp_walk_t	*walk = ctx;
+
+	if (walk->num == talloc_array_length(walk->copy)) {
+		MEM(walk->copy = talloc_realloc(NULL, walk->copy, struct radutmp,
+						walk->num ? walk->num * 2 : 1024));
 	}
+	walk->copy[walk->num++] = *(struct radutmp *)data;
 
-	/*
-	*	Lock the utmp file, prefer lockf() over flock().
-	*/
-	if (rad_lockfd(fd, LOCK_LEN) < 0) {
-		REDEBUG("Failed to acquire lock on file %s: %s", filename, fr_syserror(errno));
-		close(fd);
-		return RLM_MODULE_FAIL;
+	return 0;
+}
+
+/** Remove all sessions on a NAS, or on every NAS
+ *
+ */
+static void radutmp_zap(rlm_radutmp_t const *inst, uint32_t nas_address)
+{
+	int i;
+
+	for (i = 0; i < RADUTMP_NUM_SHARDS; i++) {
+		radutmp_shard_t	*shard = &inst->table->ports[i];
+		radutmp_walk_t	walk = { .nas_address = nas_address };
+		size_t		j;
+
+		pthread_mutex_lock(&shard->mutex);
+		(void) fr_hash_table_walk(shard->ht, _radutmp_find_nas, &walk);
+
+		for (j = 0; j < walk.num; j++) {
+			(void) fr_hash_table_yank(shard->ht, walk.found[j]);
+			radutmp_user_del(inst, walk.found[j]->login);
+			talloc_free(walk.found[j]);
+		}
+		pthread_mutex_unlock(&shard->mutex);
+
+		if (walk.num) atomic_store(&inst->table->dirty, true);
+		talloc_free(walk.found);
 	}
+}
 
-	/*
-	*	Find the entry for this NAS / portno combination.
-	*/
-	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
-		if ((nasaddr != 0 && nasaddr != u.nas_address) || u.type != P_LOGIN) {
-			continue;
+/** Write every session to the radutmp file
+ *
+ * The sessions are written to a temporary file, which is then renamed,
+ * so that radwho never sees a partial file.
+ */
+static int radutmp_snapshot(rlm_radutmp_t const *inst)
+{
+	radutmp_walk_t	walk = { .nas_address = 0 };
+	char		*tmp;
+	int		fd, i;
+	uint8_t const	*p, *end;
+
+	for (i = 0; i < RADUTMP_NUM_SHARDS; i++) {
+		radutmp_shard_t *shard = &inst->table->ports[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		(void) fr_hash_table_walk(shard->ht, _radutmp_copy, &walk);
+		pthread_mutex_unlock(&shard->mutex);
+	}
+
+	MEM(tmp = talloc_typed_asprintf(NULL, "%s.tmp", inst->filename));
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, inst->permission);
+	if (fd < 0) {
+		ERROR("Failed opening %s: %s", tmp, fr_syserror(errno));
+	error:
+		talloc_free(walk.copy);
+		talloc_free(tmp);
+		return -1;
+	}
+
+	p = (uint8_t const *) walk.copy;
+	end = p + (walk.num * sizeof(struct radutmp));
+	while (p < end) {
+		ssize_t slen;
+
+		slen = write(fd, p, end - p);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+
+			ERROR("Failed writing %s: %s", tmp, fr_syserror(errno));
+			close(fd);
+			unlink(tmp);
+			goto error;
 		}
-		/*
-		 *	Match. Zap it.
-		 */
-		if (lseek(fd, -(off_t)sizeof(u), SEEK_CUR) < 0) {
-			REDEBUG("radutmp_zap: negative lseek!");
-			lseek(fd, (off_t)0, SEEK_SET);
+		p += slen;
+	}
+	close(fd);
+
+	if (rename(tmp, inst->filename) < 0) {
+		ERROR("Failed renaming %s to %s: %s", tmp, inst->filename, fr_syserror(errno));
+		unlink(tmp);
+		goto error;
+	}
+
+	talloc_free(walk.copy);
+	talloc_free(tmp);
+
+	return 0;
+}
+
+static void *radutmp_snapshot_thread(void *arg)
+{
+	rlm_radutmp_t const	*inst = arg;
+	radutmp_table_t		*table = inst->table;
+
+	pthread_mutex_lock(&table->mutex);
+	while (!table->stop) {
+		struct timeval	now, when;
+		struct timespec	ts;
+
+		gettimeofday(&now, NULL);
+		fr_timeval_add(&when, &now, &inst->snapshot_interval);
+		ts.tv_sec = when.tv_sec;
+		ts.tv_nsec = when.tv_usec * 1000;
+
+		(void) pthread_cond_timedwait(&table->cond, &table->mutex, &ts);
+		if (table->stop) break;
+
+		pthread_mutex_unlock(&table->mutex);
+		if (atomic_exchange(&table->dirty, false) && (radutmp_snapshot(inst) < 0)) {
+			atomic_store(&table->dirty, true);
 		}
-		u.type = P_IDLE;
-		u.time = t;
+		pthread_mutex_lock(&table->mutex);
+	}
+	pthread_mutex_unlock(&table->mutex);
 
-		if (write(fd, &u, sizeof(u)) < 0) {
-			REDEBUG("Failed writing: %s", fr_syserror(errno));
+	return NULL;
+}
+
+/** Read the sessions which were written before the server was restarted
+ *
+ */
+static int radutmp_load(rlm_radutmp_t const *inst)
+{
+	struct radutmp	u;
+	int		fd;
+	uint64_t	count = 0;
 
+	fd = open(inst->filename, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) return 0;
+
+		ERROR("Error accessing file %s: %s", inst->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
+		if (u.type != P_LOGIN) continue;
+
+		if (radutmp_session_insert(inst, radutmp_port_shard(inst->table, &u), &u) < 0) {
+			ERROR("Out of memory reading %s", inst->filename);
 			close(fd);
-			return RLM_MODULE_FAIL;
+			return -1;
 		}
+		count++;
 	}
-	close(fd);	/* and implicitely release the locks */
+	close(fd);
 
-	return RLM_MODULE_OK;
+	INFO("Read %" PRIu64 " sessions from %s", count, inst->filename);
+
+	return 0;
 }
 
 /*
- *	Lookup a NAS_PORT in the nas_port_list
+ *	Count the sessions of a user
  */
-static NAS_PORT *nas_port_find(NAS_PORT *nas_port_list, uint32_t nasaddr, uint16_t port)
+static ssize_t radutmp_sessions_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
+				     void const *mod_inst, UNUSED void const *xlat_inst,
+				     UNUSED REQUEST *request, char const *fmt)
 {
-	NAS_PORT	*cl;
+	rlm_radutmp_t const *inst = mod_inst;
 
-	for(cl = nas_port_list; cl; cl = cl->next) {
-		if (nasaddr == cl->nasaddr &&
-			port == cl->port)
-			break;
+	while (isspace((int) *fmt)) fmt++;
+
+	*out = talloc_typed_asprintf(ctx, "%u", radutmp_user_count(inst, fmt));
+	return talloc_array_length(*out) - 1;
+}
+
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_radutmp_t	*inst = instance;
+	radutmp_table_t	*table;
+	char		buffer[256];
+	int		i, rcode;
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	if (timerisset(&inst->snapshot_interval)) {
+		FR_TIMEVAL_BOUND_CHECK("snapshot_interval", &inst->snapshot_interval, >=, 0, 100000);
+		FR_TIMEVAL_BOUND_CHECK("snapshot_interval", &inst->snapshot_interval, <=, 3600, 0);
+	}
+
+	/*
+	 *	Not parented to the instance, as it's changed after
+	 *	the instance is made read-only.
+	 */
+	MEM(inst->table = table = talloc_zero(NULL, radutmp_table_t));
+
+	pthread_mutex_init(&table->mutex, NULL);
+	pthread_cond_init(&table->cond, NULL);
+
+	for (i = 0; i < RADUTMP_NUM_SHARDS; i++) {
+		pthread_mutex_init(&table->ports[i].mutex, NULL);
+		MEM(table->ports[i].ht = fr_hash_table_create(table, radutmp_port_hash, radutmp_port_cmp, NULL));
+
+		pthread_mutex_init(&table->users[i].mutex, NULL);
+		MEM(table->users[i].ht = fr_hash_table_create(table, radutmp_user_hash, radutmp_user_cmp, NULL));
+	}
+
+	if (radutmp_load(inst) < 0) return -1;
+	atomic_store(&table->dirty, false);
+
+	snprintf(buffer, sizeof(buffer), "%s_sessions", inst->name);
+	xlat_register(inst, buffer, radutmp_sessions_xlat, NULL, NULL, 0, 0);
+
+	if (check_config || !timerisset(&inst->snapshot_interval)) return 0;
+
+	rcode = pthread_create(&table->thread, NULL, radutmp_snapshot_thread, inst);
+	if (rcode != 0) {
+		ERROR("Failed creating snapshot thread: %s", fr_syserror(rcode));
+		return -1;
+	}
+	table->running = true;
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_radutmp_t	*inst = instance;
+	radutmp_table_t	*table = inst->table;
+	int		i;
+
+	if (!table) return 0;
+
+	if (table->running) {
+		pthread_mutex_lock(&table->mutex);
+		table->stop = true;
+		pthread_cond_signal(&table->cond);
+		pthread_mutex_unlock(&table->mutex);
+
+		(void) pthread_join(table->thread, NULL);
+	}
+
+	/*
+	 *	Write the sessions one last time, so that they're
+	 *	still there when the server starts again.
+	 */
+	if (!check_config && atomic_load(&table->dirty)) (void) radutmp_snapshot(inst);
+
+	for (i = 0; i < RADUTMP_NUM_SHARDS; i++) {
+		pthread_mutex_destroy(&table->ports[i].mutex);
+		pthread_mutex_destroy(&table->users[i].mutex);
 	}
+	pthread_cond_destroy(&table->cond);
+	pthread_mutex_destroy(&table->mutex);
+
+	talloc_free(table);
+	inst->table = NULL;
 
-	return cl;
+	return 0;
 }
 
+/*
+ *	Check Simultaneous-Use, from the sessions we know about.
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+{
+	rlm_radutmp_t const	*inst = instance;
+	VALUE_PAIR		*vp;
+	char			*expanded = NULL;
+	uint32_t		sessions;
+
+	vp = fr_pair_find_by_num(request->control, 0, FR_SIMULTANEOUS_USE, TAG_ANY);
+	if (!vp) return RLM_MODULE_NOOP;
+
+	if (xlat_aeval(request, &expanded, request, inst->username, NULL, NULL) < 0) return RLM_MODULE_FAIL;
+
+	sessions = radutmp_user_count(inst, expanded);
+	if (sessions < vp->vp_uint32) {
+		RDEBUG2("User %s has %u session(s), and is allowed %u", expanded, sessions, vp->vp_uint32);
+		talloc_free(expanded);
+		return RLM_MODULE_OK;
+	}
+
+	REDEBUG("User %s already has %u session(s), and is allowed %u", expanded, sessions, vp->vp_uint32);
+	talloc_free(expanded);
 
+	pair_make_reply("Reply-Message", "You are already logged in - access denied", T_OP_SET);
+
+	return RLM_MODULE_REJECT;
+}
+
+#ifdef WITH_ACCOUNTING
 /*
- *	Store logins in the RADIUS utmp file.
+ *	Start, update, or stop the session on a NAS port.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t radutmp_update(rlm_radutmp_t const *inst, REQUEST *request, struct radutmp *ut,
+				  int status, char const *nas)
 {
+	radutmp_shard_t	*shard = radutmp_port_shard(inst->table, ut);
+	struct radutmp	*u;
 	rlm_rcode_t	rcode = RLM_MODULE_OK;
-	struct radutmp	ut, u;
+
+	pthread_mutex_lock(&shard->mutex);
+	u = fr_hash_table_finddata(shard->ht, ut);
+
+	/*
+	 *	The user has logged off, delete the entry.
+	 */
+	if (status == FR_STATUS_STOP) {
+		if (!u) {
+			RWDEBUG("Logout for NAS %s port %u, but no Login record", nas, ut->nas_port);
+			goto finish;
+		}
+
+		if (strncmp(ut->session_id, u->session_id, sizeof(u->session_id)) != 0) {
+			RWDEBUG("Logout entry for NAS %s port %u has wrong ID", nas, u->nas_port);
+			goto finish;
+		}
+
+		(void) fr_hash_table_yank(shard->ht, u);
+		radutmp_user_del(inst, u->login);
+		talloc_free(u);
+
+		atomic_store(&inst->table->dirty, true);
+		goto finish;
+	}
+
+	if (u && (strncmp(ut->session_id, u->session_id, sizeof(u->session_id)) == 0)) {
+		if ((status == FR_STATUS_START) && (u->time >= ut->time)) {
+			RIDEBUG("Login entry for NAS %s port %u duplicate", nas, u->nas_port);
+			goto finish;
+		}
+
+		/*
+		 *	Keep the original login time.
+		 */
+		if (status == FR_STATUS_ALIVE) ut->time = u->time;
+	}
+
+	if (radutmp_session_insert(inst, shard, ut) < 0) {
+		REDEBUG("Failed adding session for NAS %s port %u", nas, ut->nas_port);
+		rcode = RLM_MODULE_FAIL;
+	}
+
+finish:
+	pthread_mutex_unlock(&shard->mutex);
+
+	return rcode;
+}
+
+/*
+ *	Store logins in the session table.
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+{
+	struct radutmp	ut;
 	vp_cursor_t	cursor;
 	VALUE_PAIR	*vp;
 	int		status = -1;
 	int		protocol = -1;
 	time_t		t;
-	int		fd = -1;
 	bool		port_seen = false;
 	int		off;
-	rlm_radutmp_t	*inst = instance;
+	rlm_radutmp_t const *inst = instance;
 	char		ip_name[INET_ADDRSTRLEN]; /* 255.255.255.255 */
 	char const	*nas;
-	NAS_PORT	*cache;
-	int		r;
 
-	char		*filename = NULL;
 	char		*expanded = NULL;
 
 	if (request->packet->src_ipaddr.af != AF_INET) {
@@ -306,14 +800,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 
 	ut.time = t - ut.delay;
 
-	/*
-	 *	Get the utmp filename, via xlat.
-	 */
-	filename = NULL;
-	if (xlat_aeval(request, &filename, request, inst->filename, NULL, NULL) < 0) {
-		return RLM_MODULE_FAIL;
-	}
-
 	/*
 	 *	See if this was a reboot.
 	 *
@@ -322,16 +808,16 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 	 */
 	if (status == FR_STATUS_ACCOUNTING_ON && (ut.nas_address != htonl(INADDR_NONE))) {
 		RIDEBUG("NAS %s restarted (Accounting-On packet seen)", nas);
-		rcode = radutmp_zap(request, filename, ut.nas_address, ut.time);
+		radutmp_zap(inst, ut.nas_address);
 
-		goto finish;
+		return RLM_MODULE_OK;
 	}
 
 	if (status == FR_STATUS_ACCOUNTING_OFF && (ut.nas_address != htonl(INADDR_NONE))) {
 		RIDEBUG("NAS %s rebooted (Accounting-Off packet seen)", nas);
-		rcode = radutmp_zap(request, filename, ut.nas_address, ut.time);
+		radutmp_zap(inst, ut.nas_address);
 
-		goto finish;
+		return RLM_MODULE_OK;
 	}
 
 	/*
@@ -339,18 +825,14 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 	 */
 	if (status != FR_STATUS_START && status != FR_STATUS_STOP && status != FR_STATUS_ALIVE) {
 		REDEBUG("NAS %s port %u unknown packet type %d)", nas, ut.nas_port, status);
-		rcode = RLM_MODULE_NOOP;
-
-		goto finish;
+		return RLM_MODULE_NOOP;
 	}
 
 	/*
 	 *	Translate the User-Name attribute, or whatever else they told us to use.
 	 */
 	if (xlat_aeval(request, &expanded, request, inst->username, NULL, NULL) < 0) {
-		rcode = RLM_MODULE_FAIL;
-
-		goto finish;
+		return RLM_MODULE_FAIL;
 	}
 	strlcpy(ut.login, expanded, RUT_NAMESIZE);
 	TALLOC_FREE(expanded);
@@ -364,173 +846,15 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 	 */
 	if (!port_seen) {
 		RWDEBUG2("No NAS-Port seen.  Cannot do anything. Checkrad will probably not work!");
-		rcode = RLM_MODULE_NOOP;
-
-		goto finish;
+		return RLM_MODULE_NOOP;
 	}
 
 	if (strncmp(ut.login, "!root", RUT_NAMESIZE) == 0) {
 		RDEBUG2("Not recording administrative user");
-		rcode = RLM_MODULE_NOOP;
-
-		goto finish;
-	}
-
-	/*
-	 *	Enter into the radutmp file.
-	 */
-	fd = open(filename, O_RDWR|O_CREAT, inst->permission);
-	if (fd < 0) {
-		REDEBUG("Error accessing file %s: %s", filename, fr_syserror(errno));
-		rcode = RLM_MODULE_FAIL;
-
-		goto finish;
-	}
-
-	/*
-	 *	Lock the utmp file, prefer lockf() over flock().
-	 */
-	if (rad_lockfd(fd, LOCK_LEN) < 0) {
-		REDEBUG("Error acquiring lock on %s: %s", filename, fr_syserror(errno));
-		rcode = RLM_MODULE_FAIL;
-
-		goto finish;
-	}
-
-	/*
-	 *	Find the entry for this NAS / portno combination.
-	 */
-	if ((cache = nas_port_find(inst->nas_port_list, ut.nas_address, ut.nas_port)) != NULL) {
-		if (lseek(fd, (off_t)cache->offset, SEEK_SET) < 0) {
-			rcode = RLM_MODULE_FAIL;
-			goto finish;
-		}
-	}
-
-	r = 0;
-	off = 0;
-	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
-		off += sizeof(u);
-		if ((u.nas_address != ut.nas_address) || (u.nas_port != ut.nas_port)) {
-			continue;
-		}
-
-		/*
-		 *	Don't compare stop records to unused entries.
-		 */
-		if (status == FR_STATUS_STOP && u.type == P_IDLE) {
-			continue;
-		}
-
-		if ((status == FR_STATUS_STOP) && strncmp(ut.session_id, u.session_id, sizeof(u.session_id)) != 0) {
-			/*
-			 *	Don't complain if this is not a
-			 *	login record (some clients can
-			 *	send _only_ logout records).
-			 */
-			if (u.type == P_LOGIN) {
-				RWDEBUG("Logout entry for NAS %s port %u has wrong ID", nas, u.nas_port);
-			}
-
-			r = -1;
-			break;
-		}
-
-		if ((status == FR_STATUS_START) && strncmp(ut.session_id, u.session_id, sizeof(u.session_id)) == 0  &&
-		    u.time >= ut.time) {
-			if (u.type == P_LOGIN) {
-				RIDEBUG("Login entry for NAS %s port %u duplicate", nas, u.nas_port);
-				r = -1;
-				break;
-			}
-
-			RWDEBUG("Login entry for NAS %s port %u wrong order", nas, u.nas_port);
-			r = -1;
-			break;
-		}
-
-		/*
-		 *	FIXME: the ALIVE record could need some more checking, but anyway I'd
-		 *	rather rewrite this mess -- miquels.
-		 */
-		if ((status == FR_STATUS_ALIVE) && strncmp(ut.session_id, u.session_id, sizeof(u.session_id)) == 0  &&
-		    u.type == P_LOGIN) {
-			/*
-			 *	Keep the original login time.
-			 */
-			ut.time = u.time;
-		}
-
-		if (lseek(fd, -(off_t)sizeof(u), SEEK_CUR) < 0) {
-			RWDEBUG("negative lseek!");
-			lseek(fd, (off_t)0, SEEK_SET);
-			off = 0;
-		} else {
-			off -= sizeof(u);
-		}
-
-		r = 1;
-		break;
-	} /* read the file until we find a match */
-
-	/*
-	 *	Found the entry, do start/update it with
-	 *	the information from the packet.
-	 */
-	if ((r >= 0) && (status == FR_STATUS_START || status == FR_STATUS_ALIVE)) {
-		/*
-		 *	Remember where the entry was, because it's
-		 *	easier than searching through the entire file.
-		 */
-		if (!cache) {
-			cache = talloc_zero(NULL, NAS_PORT);
-			if (cache) {
-				cache->nasaddr = ut.nas_address;
-				cache->port = ut.nas_port;
-				cache->offset = off;
-				cache->next = inst->nas_port_list;
-				inst->nas_port_list = cache;
-			}
-		}
-
-		ut.type = P_LOGIN;
-		if (write(fd, &ut, sizeof(u)) < 0) {
-			REDEBUG("Failed writing: %s", fr_syserror(errno));
-
-			rcode = RLM_MODULE_FAIL;
-			goto finish;
-		}
-	}
-
-	/*
-	 *	The user has logged off, delete the entry by
-	 *	re-writing it in place.
-	 */
-	if (status == FR_STATUS_STOP) {
-		if (r > 0) {
-			u.type = P_IDLE;
-			u.time = ut.time;
-			u.delay = ut.delay;
-			if (write(fd, &u, sizeof(u)) < 0) {
-				REDEBUG("Failed writing: %s", fr_syserror(errno));
-
-				rcode = RLM_MODULE_FAIL;
-				goto finish;
-			}
-		} else if (r == 0) {
-			RWDEBUG("Logout for NAS %s port %u, but no Login record", nas, ut.nas_port);
-		}
-	}
-
-	finish:
-
-	talloc_free(filename);
-
-	if (fd > -1) {
-		close(fd);	/* and implicitely release the locks */
+		return RLM_MODULE_NOOP;
 	}
 
-	return rcode;
+	return radutmp_update(inst, request, &ut, status, nas);
 }
 #endif
 
@@ -539,13 +863,14 @@ extern rad_module_t rlm_radutmp;
 rad_module_t rlm_radutmp = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "radutmp",
-	.type		= RLM_TYPE_THREAD_UNSAFE,
 	.inst_size	= sizeof(rlm_radutmp_t),
 	.config		= module_config,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 	.methods = {
+		[MOD_AUTHORIZE]		= mod_authorize,
 #ifdef WITH_ACCOUNTING
 		[MOD_ACCOUNTING]	= mod_accounting,
 #endif
 	},
 };
-
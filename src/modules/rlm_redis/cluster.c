@@ -69,6 +69,12 @@
  *
  * See #fr_redis_cluster_state_init for example code.
  *
+ * Modules running on a worker's event loop should instead allocate a
+ * #fr_redis_cluster_thread_t per thread with #fr_redis_cluster_thread_alloc, and
+ * issue commands with #fr_redis_cluster_async_command.  Redirects, retries and
+ * reconnects are then processed without blocking, and a callback is run with the
+ * final reply, from which the module can mark the request as resumable.
+ *
  * Structures
  * ----------
  *
@@ -148,8 +154,10 @@
 #include "redis.h"
 #include "cluster.h"
 #include "crc16.h"
+#include <hiredis/async.h>
 #include <freeradius-devel/rad_assert.h>
 #include <freeradius-devel/cf_parse.h>
+#include <freeradius-devel/io/time.h>
 
 #define KEY_SLOTS		16384			//!< Maximum number of keyslots (should not change).
 
@@ -263,6 +271,8 @@ struct fr_redis_cluster {
 	cluster_key_slot_t	key_slot[KEY_SLOTS];		//!< Lookup table of slots to pools.
 	cluster_key_slot_t	key_slot_pending[KEY_SLOTS];	//!< Pending key slot table.
 
+	char const		**scripts;		//!< Lua scripts loaded on every new connection.
+
 	pthread_mutex_t		mutex;			//!< Mutex to synchronise cluster operations.
 };
 
@@ -810,50 +820,22 @@ static int cluster_map_node_validate(redisReply *node, int map_idx, int node_idx
 	return CLUSTER_OP_SUCCESS;
 }
 
-/** Learn a new cluster layout by querying the node that issued the -MOVE
+/** Validate a response to "cluster slots"
  *
- * Also validates the response from the Redis cluster, so we can be sure that
- * it's well formed, before doing more expensive operations.
+ * Ensures the map is well formed, before doing more expensive operations
+ * like applying it.
  *
  * @note Errors may be retrieved with fr_strerror().
  *
- * @param[out] out Where to write cluster map.
- * @param[in] conn to use for learning the new cluster map.
+ * @param[in] reply to "cluster slots" to validate.
  * @return
- *	- CLUSTER_OP_IGNORED if 'cluster slots' returned an error (indicating clustering not supported).
  *	- CLUSTER_OP_SUCCESS on success.
- *	- CLUSTER_OP_FAILED if issuing the command resulted in an error.
- *	- CLUSTER_OP_NO_CONNECTION connection failure.
  *	- CLUSTER_OP_BAD_INPUT on validation failure (bad data returned from Redis).
  */
-static cluster_rcode_t cluster_map_get(redisReply **out, fr_redis_conn_t *conn)
+static cluster_rcode_t cluster_map_validate(redisReply *reply)
 {
-	redisReply	*reply;
 	size_t		i = 0;
 
-	*out = NULL;
-
-	reply = redisCommand(conn->handle, "cluster slots");
-	switch (fr_redis_command_status(conn, reply)) {
-	case REDIS_RCODE_RECONNECT:
-		fr_redis_reply_free(reply);
-		fr_strerror_printf("No connections available");
-		return CLUSTER_OP_NO_CONNECTION;
-
-	case REDIS_RCODE_ERROR:
-	default:
-		if (reply && reply->type == REDIS_REPLY_ERROR) {
-			fr_redis_reply_free(reply);
-			fr_strerror_printf("%.*s", (int)reply->len, reply->str);
-			return CLUSTER_OP_IGNORED;
-		}
-		fr_strerror_printf("Unknown client error");
-		return CLUSTER_OP_FAILED;
-
-	case REDIS_RCODE_SUCCESS:
-		break;
-	}
-
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		fr_strerror_printf("Bad response to \"cluster slots\" command, expected array got %s",
 				   fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
@@ -880,7 +862,6 @@ static cluster_rcode_t cluster_map_get(redisReply **out, fr_redis_conn_t *conn)
 			fr_strerror_printf("Cluster map %zu is wrong type, expected array got %s",
 				   	   i, fr_int2str(redis_reply_types, map->type, "<UNKNOWN>"));
 		error:
-			fr_redis_reply_free(reply);
 			return CLUSTER_OP_BAD_INPUT;
 		}
 
@@ -951,6 +932,56 @@ static cluster_rcode_t cluster_map_get(redisReply **out, fr_redis_conn_t *conn)
 			if (cluster_map_node_validate(map->element[j], i, j - 2) < 0) goto error;
 		}
 	}
+
+	return CLUSTER_OP_SUCCESS;
+}
+
+/** Learn a new cluster layout by querying the node that issued the -MOVE
+ *
+ * Also validates the response from the Redis cluster with #cluster_map_validate.
+ *
+ * @note Errors may be retrieved with fr_strerror().
+ *
+ * @param[out] out Where to write cluster map.
+ * @param[in] conn to use for learning the new cluster map.
+ * @return
+ *	- CLUSTER_OP_IGNORED if 'cluster slots' returned an error (indicating clustering not supported).
+ *	- CLUSTER_OP_SUCCESS on success.
+ *	- CLUSTER_OP_FAILED if issuing the command resulted in an error.
+ *	- CLUSTER_OP_NO_CONNECTION connection failure.
+ *	- CLUSTER_OP_BAD_INPUT on validation failure (bad data returned from Redis).
+ */
+static cluster_rcode_t cluster_map_get(redisReply **out, fr_redis_conn_t *conn)
+{
+	redisReply	*reply;
+
+	*out = NULL;
+
+	reply = redisCommand(conn->handle, "cluster slots");
+	switch (fr_redis_command_status(conn, reply)) {
+	case REDIS_RCODE_RECONNECT:
+		fr_redis_reply_free(reply);
+		fr_strerror_printf("No connections available");
+		return CLUSTER_OP_NO_CONNECTION;
+
+	case REDIS_RCODE_ERROR:
+	default:
+		if (reply && reply->type == REDIS_REPLY_ERROR) {
+			fr_redis_reply_free(reply);
+			fr_strerror_printf("%.*s", (int)reply->len, reply->str);
+			return CLUSTER_OP_IGNORED;
+		}
+		fr_strerror_printf("Unknown client error");
+		return CLUSTER_OP_FAILED;
+
+	case REDIS_RCODE_SUCCESS:
+		break;
+	}
+
+	if (cluster_map_validate(reply) != CLUSTER_OP_SUCCESS) {
+		fr_redis_reply_free(reply);
+		return CLUSTER_OP_BAD_INPUT;
+	}
 	*out = reply;
 
 	return CLUSTER_OP_SUCCESS;
@@ -1531,6 +1562,30 @@ void *fr_redis_cluster_conn_create(TALLOC_CTX *ctx, void *instance, struct timev
 		}
 	}
 
+	/*
+	 *	Load scripts so callers don't see -NOSCRIPT,
+	 *	e.g. after the node has been restarted.
+	 */
+	if (node->cluster->scripts) {
+		size_t i, num = talloc_array_length(node->cluster->scripts);
+
+		DEBUG3("%s [%i]: Executing: SCRIPT LOAD (%zu scripts)", log_prefix, node->id, num);
+		for (i = 0; i < num; i++) redisAppendCommand(handle, "SCRIPT LOAD %s", node->cluster->scripts[i]);
+
+		for (i = 0; i < num; i++) {
+			if (redisGetReply(handle, (void **)&reply) != REDIS_OK) {
+				ERROR("%s [%i]: Failed loading scripts: %s", log_prefix, node->id, handle->errstr);
+				goto error;
+			}
+
+			if (reply->type == REDIS_REPLY_ERROR) {
+				WARN("%s [%i]: Failed loading script: %s", log_prefix, node->id, reply->str);
+			}
+			fr_redis_reply_free(reply);
+		}
+		reply = NULL;
+	}
+
 	conn = talloc_zero(ctx, fr_redis_conn_t);
 	conn->handle = handle;
 	talloc_set_destructor(conn, _cluster_conn_free);
@@ -2154,6 +2209,60 @@ bool fr_redis_cluster_min_version(fr_redis_cluster_t *cluster, char const *min_v
 	return ret < 0 ? false : true;
 }
 
+/** Load a script on a node, so it's available to EVALSHA
+ *
+ * @param context script to load.
+ * @param data node to load the script on.
+ * @return 0 (continue walking).
+ */
+static int _cluster_script_walk(void *context, void *data)
+{
+	char const		*script = context;
+	cluster_node_t		*node = data;
+	fr_redis_conn_t		*conn;
+	redisReply		*reply;
+
+	conn = fr_pool_connection_get(node->pool, NULL);
+	if (!conn) return 0;
+
+	reply = redisCommand(conn->handle, "SCRIPT LOAD %s", script);
+	if (fr_redis_command_status(conn, reply) != REDIS_RCODE_SUCCESS) {
+		WARN("%s [%i]: Failed loading script on %s:%i: %s", node->cluster->log_prefix, node->id,
+		     node->name, node->addr.port, fr_strerror());
+	}
+	fr_redis_reply_free(reply);
+	fr_pool_connection_release(node->pool, NULL, conn);
+
+	return 0;
+}
+
+/** Load a Lua script on every node in the cluster, and on every new connection
+ *
+ * Avoids the round trip (and upload) after a '-NOSCRIPT' error the first time
+ * a node sees each script, or after a node is restarted.  Callers should still
+ * handle '-NOSCRIPT', as nodes may flush their script caches at any time.
+ *
+ * @note Must be called during instantiation, before connections are shared
+ *	between threads.
+ *
+ * @param cluster to load the script on.
+ * @param script Lua source.  Must remain valid for the lifetime of the cluster.
+ */
+void fr_redis_cluster_script_preload(fr_redis_cluster_t *cluster, char const *script)
+{
+	size_t	num = talloc_array_length(cluster->scripts);
+	char	*p;
+
+	MEM(cluster->scripts = talloc_realloc(cluster, cluster->scripts, char const *, num + 1));
+	cluster->scripts[num] = script;
+
+	memcpy(&p, &script, sizeof(p));
+
+	pthread_mutex_lock(&cluster->mutex);
+	rbtree_walk(cluster->used_nodes, RBTREE_IN_ORDER, _cluster_script_walk, p);
+	pthread_mutex_unlock(&cluster->mutex);
+}
+
 /** Allocate and initialise a new cluster structure
  *
  * This holds all the data necessary to manage a pool of pools for a specific redis cluster.
@@ -2451,3 +2560,865 @@ fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 
 	return cluster;
 }
+
+/*
+ *	Asynchronous cluster client
+ *
+ *	Each worker thread has its own set of hiredis async contexts, one per
+ *	cluster node it has talked to, which are driven by the worker's event
+ *	list.  The key slot table, and the code that applies new cluster maps,
+ *	are shared with the synchronous client above.
+ *
+ *	Commands are routed using the key slot table, and '-MOVE', '-ASK' and
+ *	'-TRYAGAIN' responses are processed from the reply callback, so the
+ *	worker never blocks waiting on a node.
+ *
+ *	Commands aren't written as they're issued.  Hiredis appends them to the
+ *	connection's output buffer, and a zero delay timer flushes every connection
+ *	with pending output on the next pass of the event loop.  All the commands
+ *	for a node issued by the thread's requests in one pass are written as a
+ *	single pipeline, and hiredis matches the replies back to the commands in
+ *	order.
+ */
+
+/** An async connection to a single cluster node, owned by one thread
+ */
+typedef struct cluster_async_conn {
+	char				name[INET6_ADDRSTRLEN];	//!< Buffer to hold IP string.
+								//!< text for debug messages.
+	fr_socket_addr_t		addr;			//!< Address of the node.
+
+	fr_redis_cluster_thread_t	*thread;		//!< Thread the connection belongs to.
+	redisAsyncContext		*ac;			//!< Hiredis async context.
+	int				fd;			//!< Registered with the event list.
+
+	bool				read;			//!< Hiredis wants read events.
+	bool				write;			//!< Hiredis wants write events.
+	bool				connected;		//!< Connection has completed.
+	bool				in_write;		//!< Hiredis is writing the output buffer.
+	bool				linked;			//!< In the thread's connection tree.
+	bool				freeing;		//!< Being freed by us, not by hiredis.
+
+	bool				flush_pending;		//!< In the thread's flush list.
+	fr_dlist_t			flush_entry;		//!< Entry in the thread's flush list.
+} cluster_async_conn_t;
+
+/** Per-thread async state for a cluster
+ */
+struct fr_redis_cluster_thread {
+	fr_redis_cluster_t		*cluster;		//!< Cluster commands are sent to.
+	fr_event_list_t			*el;			//!< Event list of the worker.
+	rbtree_t			*conns;			//!< Async connections, ordered by node address.
+
+	fr_dlist_t			flush;			//!< Connections with commands waiting to be written.
+	fr_event_timer_t const		*flush_ev;		//!< Flushes connections on the next loop pass.
+
+	bool				remapping;		//!< Waiting for a "cluster slots" reply.
+	bool				freeing;		//!< Thread is exiting, don't retry commands.
+};
+
+/** An async command, and the state needed to redirect or retry it
+ */
+struct fr_redis_cluster_async {
+	fr_redis_cluster_thread_t	*thread;		//!< Thread the command was issued from.
+	REQUEST				*request;		//!< The current request, NULL if cancelled.
+
+	fr_redis_cluster_async_cb_t	callback;		//!< Called with the final reply.
+	void				*uctx;			//!< Passed to the callback.
+
+	uint8_t const			*key;			//!< Key we performed hashing on.
+	size_t				key_len;		//!< Length of the key.
+	bool				read_only;		//!< Whether slaves may be used.
+
+	int				argc;			//!< Number of arguments.
+	char const			**argv;			//!< Command arguments.
+	size_t				*argv_len;		//!< Lengths of the arguments.
+
+	fr_socket_addr_t		addr;			//!< Node the command is sent to.
+	cluster_async_conn_t		*conn;			//!< Connection the command is in flight on.
+	fr_event_timer_t const		*ev;			//!< -TRYAGAIN retry timer.
+
+	uint32_t			redirects;		//!< How many redirects have we followed.
+	uint32_t			retries;		//!< How many times we've received TRYAGAIN.
+	uint32_t			reconnects;		//!< How many connections we've tried.
+};
+
+static int cluster_async_send(fr_redis_cluster_async_t *cmd, bool asking);
+static void cluster_async_conn_events(cluster_async_conn_t *conn);
+
+/** Compare two async connections by node address
+ *
+ * @param[in] a first connection.
+ * @param[in] b second connection.
+ * @return
+ *	- 0 if connections are to the same node.
+ *	- +1 if nodes are unequal.
+ *	- -1 if nodes are unequal.
+ */
+static int _cluster_async_conn_cmp(void const *a, void const *b)
+{
+	cluster_async_conn_t const *my_a = a, *my_b = b;
+	int ret;
+
+	ret = fr_ipaddr_cmp(&my_a->addr.ipaddr, &my_b->addr.ipaddr);
+	if (ret != 0) return ret;
+
+	return my_a->addr.port - my_b->addr.port;
+}
+
+/** Remove a connection from the thread's tree, so new commands get a new connection
+ *
+ * @param[in] conn to unlink.
+ */
+static void cluster_async_conn_unlink(cluster_async_conn_t *conn)
+{
+	if (!conn->linked) return;
+
+	if (!conn->thread->freeing) rbtree_deletebydata(conn->thread->conns, conn);
+	conn->linked = false;
+}
+
+static void _cluster_async_conn_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	cluster_async_conn_t *conn = uctx;
+
+	redisAsyncHandleRead(conn->ac);	/* May free conn */
+}
+
+/** Write as much of the output buffer as the socket will take
+ *
+ * @param[in] conn to write.  May be freed.
+ */
+static void cluster_async_conn_write(cluster_async_conn_t *conn)
+{
+	conn->in_write = true;
+	redisAsyncHandleWrite(conn->ac);
+	conn->in_write = false;
+
+	if (!conn->ac) talloc_free(conn);	/* Freed by hiredis during the write */
+}
+
+static void _cluster_async_conn_write(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	cluster_async_conn_write(uctx);
+}
+
+/** Write the pipelined commands for every connection with pending output
+ */
+static void _cluster_async_flush(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	fr_redis_cluster_thread_t	*thread = uctx;
+	fr_dlist_t			*entry;
+
+	thread->flush_ev = NULL;
+
+	while ((entry = FR_DLIST_FIRST(thread->flush))) {
+		cluster_async_conn_t *conn = fr_ptr_to_type(cluster_async_conn_t, flush_entry, entry);
+
+		fr_dlist_remove(entry);
+		conn->flush_pending = false;
+
+		cluster_async_conn_write(conn);
+	}
+}
+
+/** Add a connection to the flush list, scheduling a flush if needed
+ *
+ * @param[in] conn with pending output.
+ */
+static void cluster_async_flush_schedule(cluster_async_conn_t *conn)
+{
+	fr_redis_cluster_thread_t	*thread = conn->thread;
+	struct timeval			now;
+
+	if (conn->flush_pending) return;
+
+	fr_dlist_insert_tail(&thread->flush, &conn->flush_entry);
+	conn->flush_pending = true;
+
+	if (thread->flush_ev) return;
+
+	gettimeofday(&now, NULL);
+	if (fr_event_timer_insert(thread, thread->el, &thread->flush_ev, &now, _cluster_async_flush, thread) < 0) {
+		PERROR("%s: Failed scheduling flush", thread->cluster->log_prefix);
+
+		/*
+		 *	Fall back to writing when the
+		 *	socket is writable.
+		 */
+		fr_dlist_remove(&conn->flush_entry);
+		conn->flush_pending = false;
+		conn->write = true;
+		cluster_async_conn_events(conn);
+	}
+}
+
+static void _cluster_async_conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+				      int fd_errno, void *uctx)
+{
+	cluster_async_conn_t *conn = uctx;
+
+	ERROR("%s: Connection to %s:%i failed: %s", conn->thread->cluster->log_prefix,
+	      conn->name, conn->addr.port, fr_syserror(fd_errno));
+
+	cluster_async_conn_unlink(conn);
+	redisAsyncFree(conn->ac);	/* Frees conn */
+}
+
+/** Update the events we're registered for, to match what hiredis wants
+ *
+ * @param[in] conn to update events for.
+ */
+static void cluster_async_conn_events(cluster_async_conn_t *conn)
+{
+	fr_event_list_t *el = conn->thread->el;
+
+	if (!conn->read && !conn->write) {
+		(void) fr_event_fd_delete(el, conn->fd);
+		return;
+	}
+
+	if (fr_event_fd_insert(conn, el, conn->fd,
+			       conn->read ? _cluster_async_conn_read : NULL,
+			       conn->write ? _cluster_async_conn_write : NULL,
+			       _cluster_async_conn_error, conn) < 0) {
+		PERROR("%s: Failed updating events for %s:%i", conn->thread->cluster->log_prefix,
+		       conn->name, conn->addr.port);
+	}
+}
+
+/*
+ *	Hiredis event adapter callbacks
+ */
+static void _cluster_async_add_read(void *privdata)
+{
+	cluster_async_conn_t *conn = privdata;
+
+	conn->read = true;
+	cluster_async_conn_events(conn);
+}
+
+static void _cluster_async_del_read(void *privdata)
+{
+	cluster_async_conn_t *conn = privdata;
+
+	conn->read = false;
+	cluster_async_conn_events(conn);
+}
+
+static void _cluster_async_add_write(void *privdata)
+{
+	cluster_async_conn_t *conn = privdata;
+
+	/*
+	 *	Commands queued outside of a write are
+	 *	batched up, and written by the flush.
+	 *
+	 *	We still need the write event to complete
+	 *	the connection, or if the socket couldn't
+	 *	take all the output.
+	 */
+	if (conn->connected && !conn->in_write) {
+		cluster_async_flush_schedule(conn);
+		return;
+	}
+
+	conn->write = true;
+	cluster_async_conn_events(conn);
+}
+
+static void _cluster_async_del_write(void *privdata)
+{
+	cluster_async_conn_t *conn = privdata;
+
+	conn->write = false;
+	cluster_async_conn_events(conn);
+}
+
+/** Called by hiredis when the async context is being freed
+ *
+ * All pending command callbacks have been run (with NULL replies) by the
+ * time this is called, so nothing references conn any more.
+ */
+static void _cluster_async_cleanup(void *privdata)
+{
+	cluster_async_conn_t *conn = privdata;
+
+	conn->read = false;
+	conn->write = false;
+	cluster_async_conn_events(conn);
+
+	conn->ac = NULL;
+	cluster_async_conn_unlink(conn);
+
+	if (!conn->freeing && !conn->in_write) talloc_free(conn);
+}
+
+static void _cluster_async_connect(redisAsyncContext const *ac, int status)
+{
+	cluster_async_conn_t *conn = ac->ev.data;
+
+	if (status != REDIS_OK) {
+		ERROR("%s: Connection to %s:%i failed: %s", conn->thread->cluster->log_prefix,
+		      conn->name, conn->addr.port, ac->errstr);
+		return;
+	}
+
+	DEBUG2("%s: Connected to %s:%i", conn->thread->cluster->log_prefix, conn->name, conn->addr.port);
+	conn->connected = true;
+}
+
+/** Log failures of the AUTH and SELECT commands sent on connect
+ *
+ * Any commands queued after them will fail too, so there's nothing else
+ * to do here.
+ */
+static void _cluster_async_setup(UNUSED redisAsyncContext *ac, void *r, void *privdata)
+{
+	cluster_async_conn_t	*conn = privdata;
+	redisReply		*reply = r;
+
+	if (!reply || (reply->type != REDIS_REPLY_ERROR)) return;
+
+	ERROR("%s: Failed setting up connection to %s:%i: %s", conn->thread->cluster->log_prefix,
+	      conn->name, conn->addr.port, reply->str);
+}
+
+static int _cluster_async_conn_free(cluster_async_conn_t *conn)
+{
+	cluster_async_conn_unlink(conn);
+
+	if (conn->flush_pending) {
+		fr_dlist_remove(&conn->flush_entry);
+		conn->flush_pending = false;
+	}
+
+	if (conn->ac) {
+		conn->freeing = true;
+		redisAsyncFree(conn->ac);	/* Runs pending callbacks with NULL replies */
+	}
+
+	return 0;
+}
+
+/** Find or create an async connection to a node
+ *
+ * The connection completes asynchronously, commands may be queued on it
+ * immediately.
+ *
+ * @note Errors may be retrieved with fr_strerror().
+ *
+ * @param[in] thread to find the connection in.
+ * @param[in] addr of the node.
+ * @return
+ *	- The connection on success.
+ *	- NULL on failure.
+ */
+static cluster_async_conn_t *cluster_async_conn_get(fr_redis_cluster_thread_t *thread, fr_socket_addr_t const *addr)
+{
+	fr_redis_conf_t		*conf = thread->cluster->conf;
+	cluster_async_conn_t	find, *conn;
+	redisAsyncContext	*ac;
+
+	find.addr = *addr;
+	conn = rbtree_finddata(thread->conns, &find);
+	if (conn) return conn;
+
+	MEM(conn = talloc_zero(thread, cluster_async_conn_t));
+	conn->thread = thread;
+	conn->addr = *addr;
+	fr_inet_ntop(conn->name, sizeof(conn->name), &addr->ipaddr);
+
+	DEBUG2("%s: Connecting to %s:%i", thread->cluster->log_prefix, conn->name, conn->addr.port);
+
+	ac = redisAsyncConnect(conn->name, conn->addr.port);
+	if (!ac) {
+		fr_strerror_printf("Out of memory");
+	error:
+		talloc_free(conn);
+		return NULL;
+	}
+	if (ac->err) {
+		fr_strerror_printf("Connection to %s:%i failed: %s", conn->name, conn->addr.port, ac->errstr);
+		redisAsyncFree(ac);
+		goto error;
+	}
+
+	conn->ac = ac;
+	conn->fd = ac->c.fd;
+	ac->ev.data = conn;
+	ac->ev.addRead = _cluster_async_add_read;
+	ac->ev.delRead = _cluster_async_del_read;
+	ac->ev.addWrite = _cluster_async_add_write;
+	ac->ev.delWrite = _cluster_async_del_write;
+	ac->ev.cleanup = _cluster_async_cleanup;
+	talloc_set_destructor(conn, _cluster_async_conn_free);
+
+	redisAsyncSetConnectCallback(ac, _cluster_async_connect);
+
+	/*
+	 *	Queued ahead of any other command, so
+	 *	they all run authenticated.
+	 */
+	if (conf->password) {
+		DEBUG3("%s: Executing: AUTH %s", thread->cluster->log_prefix, conf->password);
+		redisAsyncCommand(ac, _cluster_async_setup, conn, "AUTH %s", conf->password);
+	}
+	if (conf->database) {
+		DEBUG3("%s: Executing: SELECT %i", thread->cluster->log_prefix, conf->database);
+		redisAsyncCommand(ac, _cluster_async_setup, conn, "SELECT %i", conf->database);
+	}
+	if (thread->cluster->scripts) {
+		size_t i;
+
+		for (i = 0; i < talloc_array_length(thread->cluster->scripts); i++) {
+			redisAsyncCommand(ac, _cluster_async_setup, conn, "SCRIPT LOAD %s",
+					  thread->cluster->scripts[i]);
+		}
+	}
+
+	/*
+	 *	Writability signals the connection
+	 *	has completed.
+	 */
+	_cluster_async_add_write(conn);
+
+	rbtree_insert(thread->conns, conn);
+	conn->linked = true;
+
+	return conn;
+}
+
+/** Process the reply to an async "cluster slots" command
+ *
+ * Validates the map, and applies it under the mutex, using the same rules
+ * as #cluster_remap to avoid applying maps too often.
+ */
+static void _cluster_async_map(UNUSED redisAsyncContext *ac, void *r, void *privdata)
+{
+	fr_redis_cluster_thread_t	*thread = privdata;
+	fr_redis_cluster_t		*cluster = thread->cluster;
+	redisReply			*reply = r;
+	cluster_rcode_t			ret;
+	time_t				now;
+
+	thread->remapping = false;
+	if (thread->freeing || !reply) return;
+
+	/*
+	 *	Clustering not enabled, or not supported
+	 */
+	if (reply->type == REDIS_REPLY_ERROR) {
+		DEBUG2("%s: Remap ignored: %s", cluster->log_prefix, reply->str);
+		cluster->remap_needed = false;
+		return;
+	}
+
+	if (cluster_map_validate(reply) != CLUSTER_OP_SUCCESS) {
+		PERROR("%s: Remap failed", cluster->log_prefix);
+		return;
+	}
+
+	now = time(NULL);
+
+	pthread_mutex_lock(&cluster->mutex);
+	if (cluster->remapping || (now == cluster->last_updated)) {
+		pthread_mutex_unlock(&cluster->mutex);
+		return;
+	}
+	ret = cluster_map_apply(cluster, reply);
+	if (ret == CLUSTER_OP_SUCCESS) cluster->remap_needed = false;
+	pthread_mutex_unlock(&cluster->mutex);
+
+	if (ret < 0) {
+		PERROR("%s: Remap failed", cluster->log_prefix);
+		return;
+	}
+
+	INFO("%s: Cluster map updated, %zu key ranges", cluster->log_prefix, reply->elements);
+}
+
+/** Request a new cluster map without blocking
+ *
+ * @param[in] thread issuing the remap.
+ * @param[in] ac to send "cluster slots" on.
+ * @param[in] request The current request.
+ */
+static void cluster_async_remap(fr_redis_cluster_thread_t *thread, redisAsyncContext *ac, REQUEST *request)
+{
+	fr_redis_cluster_t *cluster = thread->cluster;
+
+	if (thread->remapping || cluster->remapping) {
+		RDEBUG("Cluster remapping in progress, ignoring remap request");
+		return;
+	}
+
+	if (time(NULL) == cluster->last_updated) {
+		RDEBUG("Cluster was updated less than a second ago, ignoring remap request");
+		return;
+	}
+
+	if (redisAsyncCommand(ac, _cluster_async_map, thread, "cluster slots") != REDIS_OK) return;
+
+	RINFO("Initiating cluster remap");
+	thread->remapping = true;
+}
+
+/** Resolve the command's key to the address of a node
+ *
+ * @note Errors may be retrieved with fr_strerror().
+ *
+ * @param[in] cmd to route.
+ * @return
+ *	- 0 on success.
+ *	- -1 if there are no nodes in the cluster.
+ */
+static int cluster_async_route(fr_redis_cluster_async_t *cmd)
+{
+	fr_redis_cluster_t	*cluster = cmd->thread->cluster;
+	REQUEST			*request = cmd->request;
+	cluster_key_slot_t	*key_slot;
+	cluster_node_t		*node;
+
+	pthread_mutex_lock(&cluster->mutex);
+	if (rbtree_num_elements(cluster->used_nodes) == 0) {
+		pthread_mutex_unlock(&cluster->mutex);
+		fr_strerror_printf("No nodes in cluster");
+		return -1;
+	}
+
+	key_slot = cluster_slot_by_key(cluster, request, cmd->key, cmd->key_len);
+	if (cmd->read_only && key_slot->slave_num) {
+		node = &cluster->node[key_slot->slave[fr_rand() % key_slot->slave_num]];
+	} else {
+		node = &cluster->node[key_slot->master];
+	}
+	cmd->addr = node->addr;
+	pthread_mutex_unlock(&cluster->mutex);
+
+	return 0;
+}
+
+/** Retry a command after receiving '-TRYAGAIN'
+ */
+static void _cluster_async_retry(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	fr_redis_cluster_async_t	*cmd = uctx;
+	REQUEST				*request = cmd->request;
+
+	cmd->ev = NULL;
+
+	if (cluster_async_send(cmd, false) == 0) return;
+
+	RPERROR("Failed retrying command");
+	cmd->callback(request, REDIS_RCODE_RECONNECT, NULL, cmd->uctx);
+	talloc_free(cmd);
+}
+
+/** Process the reply to a command, following redirects and retrying as needed
+ *
+ * @note The reply is freed by hiredis when this function returns.
+ */
+static void _cluster_async_reply(redisAsyncContext *ac, void *r, void *privdata)
+{
+	fr_redis_cluster_async_t	*cmd = privdata;
+	fr_redis_cluster_thread_t	*thread = cmd->thread;
+	fr_redis_cluster_t		*cluster = thread->cluster;
+	cluster_async_conn_t		*conn = cmd->conn;
+	REQUEST				*request = cmd->request;
+	redisReply			*reply = r;
+	fr_redis_conn_t			tmp = { .handle = &ac->c };
+	fr_redis_rcode_t		status;
+	fr_socket_addr_t		addr;
+
+	cmd->conn = NULL;
+
+	/*
+	 *	Cancelled, or the thread is exiting,
+	 *	nothing to give the reply to.
+	 */
+	if (!request || thread->freeing) {
+		talloc_free(cmd);
+		return;
+	}
+
+	/*
+	 *	Hiredis runs callbacks with NULL replies when
+	 *	the connection fails, or is being freed.
+	 */
+	if (!reply) {
+		if (ac->c.err) {
+			fr_strerror_printf("Connection error: %s", ac->c.errstr);
+		} else {
+			fr_strerror_printf("Connection closed");
+		}
+		status = REDIS_RCODE_RECONNECT;
+	} else {
+		fr_redis_reply_print(L_DBG_LVL_3, reply, request, 0);
+		status = fr_redis_command_status(&tmp, reply);
+	}
+	RDEBUG2("<<< Returned: %s", fr_int2str(redis_rcodes, status, "<UNKNOWN>"));
+
+	switch (status) {
+	case REDIS_RCODE_SUCCESS:
+	case REDIS_RCODE_ERROR:
+	case REDIS_RCODE_NO_SCRIPT:
+		break;
+
+	/*
+	 *	Cluster's unstable, try again.
+	 */
+	case REDIS_RCODE_TRY_AGAIN:
+		if (cmd->retries++ >= cluster->conf->max_retries) {
+			REDEBUG("Hit maximum retry attempts");
+			status = REDIS_RCODE_ERROR;
+			break;
+		}
+
+		if (timerisset(&cluster->conf->retry_delay)) {
+			struct timeval when;
+
+			gettimeofday(&when, NULL);
+			fr_timeval_add(&when, &when, &cluster->conf->retry_delay);
+
+			if (fr_event_timer_insert(cmd, thread->el, &cmd->ev, &when, _cluster_async_retry, cmd) == 0) {
+				return;
+			}
+		}
+
+		if (cluster_async_send(cmd, false) == 0) return;
+		RPERROR("Failed retrying command");
+		status = REDIS_RCODE_RECONNECT;
+		break;
+
+	/*
+	 *	Connection's dead, resolve the key again
+	 *	and try a new connection.
+	 */
+	case REDIS_RCODE_RECONNECT:
+		RERROR("Failed communicating with %s:%i: %s", conn->name, conn->addr.port, fr_strerror());
+
+		cluster_async_conn_unlink(conn);
+		cluster->remap_needed = true;
+
+		if (cmd->reconnects++ >= cluster->conf->max_alt) {
+			REDEBUG("Hit maximum reconnect attempts");
+			break;
+		}
+
+		if ((cluster_async_route(cmd) == 0) && (cluster_async_send(cmd, false) == 0)) return;
+		RPERROR("Failed reconnecting");
+		break;
+
+	/*
+	 *	-MOVE is treated identically to -ASK, except
+	 *	it triggers a cluster remap.
+	 */
+	case REDIS_RCODE_MOVE:
+		cluster_async_remap(thread, ac, request);
+		/* FALL-THROUGH */
+
+	case REDIS_RCODE_ASK:
+		RDEBUG("Processing redirect \"%s\"", reply->str);
+		if (cmd->redirects++ >= cluster->conf->max_redirects) {
+			REDEBUG("Reached max_redirects (%i)", cmd->redirects);
+			status = REDIS_RCODE_ERROR;
+			break;
+		}
+
+		if (cluster_node_conf_from_redirect(NULL, &addr, reply) < 0) {
+			RPEDEBUG("Invalid redirect");
+			status = REDIS_RCODE_ERROR;
+			break;
+		}
+
+		if ((fr_ipaddr_cmp(&addr.ipaddr, &cmd->addr.ipaddr) == 0) && (addr.port == cmd->addr.port)) {
+			REDEBUG("%s:%i issued redirect to itself", conn->name, conn->addr.port);
+			status = REDIS_RCODE_ERROR;
+			break;
+		}
+
+		cmd->addr = addr;
+		cmd->retries = 0;
+		cmd->reconnects = 0;
+
+		/*
+		 *	-ASK is a one-off redirect, the target
+		 *	needs an ASKING command first.
+		 */
+		if (cluster_async_send(cmd, status == REDIS_RCODE_ASK) == 0) return;
+		RPERROR("Failed following redirect");
+		status = REDIS_RCODE_RECONNECT;
+		break;
+	}
+
+	cmd->callback(request, status, reply, cmd->uctx);
+	talloc_free(cmd);
+}
+
+/** Queue a command on a connection to the node the command is routed to
+ *
+ * @note Errors may be retrieved with fr_strerror().
+ *
+ * @param[in] cmd to send.
+ * @param[in] asking precede the command with ASKING, for '-ASK' redirects.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int cluster_async_send(fr_redis_cluster_async_t *cmd, bool asking)
+{
+	REQUEST			*request = cmd->request;
+	cluster_async_conn_t	*conn;
+
+	conn = cluster_async_conn_get(cmd->thread, &cmd->addr);
+	if (!conn) return -1;
+
+	if (asking && (redisAsyncCommand(conn->ac, NULL, NULL, "ASKING") != REDIS_OK)) {
+	error:
+		fr_strerror_printf("Failed queuing command for %s:%i: %s", conn->name, conn->addr.port, conn->ac->errstr);
+		return -1;
+	}
+
+	if (redisAsyncCommandArgv(conn->ac, _cluster_async_reply, cmd,
+				  cmd->argc, cmd->argv, cmd->argv_len) != REDIS_OK) goto error;
+	cmd->conn = conn;
+
+	RDEBUG2(">>> Sending command(s) to %s:%i", conn->name, conn->addr.port);
+
+	return 0;
+}
+
+/** Send a command to the cluster without blocking
+ *
+ * The command is routed using the key, and any redirects, retries and reconnects
+ * needed to complete it are processed on the thread's event list.  When the command
+ * completes or fails, callback is called with the final status and reply.
+ *
+ * The reply passed to the callback is freed when the callback returns, and must
+ * not be retained.
+ *
+ * @note Errors may be retrieved with fr_strerror().
+ *
+ * @param[in] thread to issue the command from.
+ * @param[in] request The current request.
+ * @param[in] key to resolve to a cluster node.  If NULL, or key_len is 0 a random
+ *	slot will be chosen.
+ * @param[in] key_len Length of the key.
+ * @param[in] read_only If true, will use a random slave in preference to the master.
+ * @param[in] argc Number of arguments.
+ * @param[in] argv Command arguments, copied.
+ * @param[in] argv_len Lengths of the arguments, or NULL if argv are strings.
+ * @param[in] callback to call with the result.
+ * @param[in] uctx to pass to the callback.
+ * @return
+ *	- A handle which may be passed to #fr_redis_cluster_async_cancel.
+ *	- NULL on failure, the callback will not be called.
+ */
+fr_redis_cluster_async_t *fr_redis_cluster_async_command(fr_redis_cluster_thread_t *thread, REQUEST *request,
+							 uint8_t const *key, size_t key_len, bool read_only,
+							 int argc, char const **argv, size_t const *argv_len,
+							 fr_redis_cluster_async_cb_t callback, void *uctx)
+{
+	fr_redis_cluster_async_t	*cmd;
+	int				i;
+
+	rad_assert(thread && request && callback);
+
+	MEM(cmd = talloc_zero(thread, fr_redis_cluster_async_t));
+	cmd->thread = thread;
+	cmd->request = request;
+	cmd->callback = callback;
+	cmd->uctx = uctx;
+	cmd->read_only = read_only;
+
+	if (key && (key_len > 0)) {
+		MEM(cmd->key = talloc_memdup(cmd, key, key_len));
+		cmd->key_len = key_len;
+	}
+
+	cmd->argc = argc;
+	MEM(cmd->argv = talloc_array(cmd, char const *, argc));
+	MEM(cmd->argv_len = talloc_array(cmd, size_t, argc));
+	for (i = 0; i < argc; i++) {
+		cmd->argv_len[i] = argv_len ? argv_len[i] : strlen(argv[i]);
+		MEM(cmd->argv[i] = talloc_memdup(cmd->argv, argv[i], cmd->argv_len[i]));
+	}
+
+	if ((cluster_async_route(cmd) < 0) || (cluster_async_send(cmd, false) < 0)) {
+		talloc_free(cmd);
+		return NULL;
+	}
+
+	return cmd;
+}
+
+/** Cancel an async command
+ *
+ * The callback will not be called.  If the command is in flight, its reply
+ * is discarded when it arrives.
+ *
+ * @param[in] cmd to cancel.
+ */
+void fr_redis_cluster_async_cancel(fr_redis_cluster_async_t *cmd)
+{
+	cmd->request = NULL;
+
+	if (cmd->conn) return;	/* Freed by the reply callback */
+
+	talloc_free(cmd);	/* Also removes the retry timer */
+}
+
+static int _cluster_thread_walk_free(UNUSED void *ctx, void *data)
+{
+	cluster_async_conn_t *conn = data;
+
+	conn->linked = false;
+	talloc_free(conn);
+
+	return 2;
+}
+
+static int _fr_redis_cluster_thread_free(fr_redis_cluster_thread_t *thread)
+{
+	thread->freeing = true;
+
+	/*
+	 *	Close the connections while the
+	 *	commands they reference still exist.
+	 */
+	rbtree_walk(thread->conns, RBTREE_DELETE_ORDER, _cluster_thread_walk_free, NULL);
+
+	return 0;
+}
+
+/** Allocate per-thread state for issuing async commands to a cluster
+ *
+ * Connections to nodes are opened on demand, and serviced by el.
+ *
+ * @param[in] ctx to allocate the thread state in.  Should be freed before el.
+ * @param[in] cluster commands will be sent to.
+ * @param[in] el of the worker thread.
+ * @return
+ *	- New thread state on success.
+ *	- NULL on failure.
+ */
+fr_redis_cluster_thread_t *fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_redis_cluster_t *cluster,
+							 fr_event_list_t *el)
+{
+	fr_redis_cluster_thread_t *thread;
+
+	MEM(thread = talloc_zero(ctx, fr_redis_cluster_thread_t));
+	thread->cluster = cluster;
+	thread->el = el;
+	FR_DLIST_INIT(thread->flush);
+
+	thread->conns = rbtree_create(thread, _cluster_async_conn_cmp, NULL, 0);
+	if (!thread->conns) {
+		talloc_free(thread);
+		return NULL;
+	}
+	talloc_set_destructor(thread, _fr_redis_cluster_thread_free);
+
+	return thread;
+}
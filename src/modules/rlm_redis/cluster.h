@@ -75,6 +75,32 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 					     fr_redis_cluster_t *cluster, REQUEST *request,
 					     fr_redis_rcode_t status, redisReply **reply);
 
+/*
+ *	Asynchronous commands, serviced by a worker's event list.
+ */
+typedef struct fr_redis_cluster_thread fr_redis_cluster_thread_t;
+typedef struct fr_redis_cluster_async fr_redis_cluster_async_t;
+
+/** Called when an async command completes
+ *
+ * @param[in] request	The request the command was issued for.
+ * @param[in] status	Final status of the command.
+ * @param[in] reply	Final reply, may be NULL.  Freed when the callback returns.
+ * @param[in] uctx	passed to #fr_redis_cluster_async_command.
+ */
+typedef void (*fr_redis_cluster_async_cb_t)(REQUEST *request, fr_redis_rcode_t status,
+					    redisReply *reply, void *uctx);
+
+fr_redis_cluster_thread_t *fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_redis_cluster_t *cluster,
+							 fr_event_list_t *el);
+
+fr_redis_cluster_async_t *fr_redis_cluster_async_command(fr_redis_cluster_thread_t *thread, REQUEST *request,
+							 uint8_t const *key, size_t key_len, bool read_only,
+							 int argc, char const **argv, size_t const *argv_len,
+							 fr_redis_cluster_async_cb_t callback, void *uctx);
+
+void fr_redis_cluster_async_cancel(fr_redis_cluster_async_t *cmd);
+
 /*
  *	Useful for running commands over every node, such as PING
  *	or KEYS.
@@ -89,6 +115,8 @@ ssize_t fr_redis_cluster_node_addr_by_role(TALLOC_CTX *ctx, fr_socket_addr_t *ou
  */
 bool fr_redis_cluster_min_version(fr_redis_cluster_t *cluster, char const *min_version);
 
+void fr_redis_cluster_script_preload(fr_redis_cluster_t *cluster, char const *script);
+
 fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 					   CONF_SECTION *module,
 					   fr_redis_conf_t *conf,
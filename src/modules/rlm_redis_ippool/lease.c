@@ -0,0 +1,320 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file lease.c
+ * @brief Leases known to all workers, so renewals needn't go to Redis.
+ *
+ * Most DHCP requests are a device renewing the address it already has.
+ * Each one used to run the update script, and wait for it.  Once a lease
+ * has been updated in Redis, it's kept here, by pool and device, and
+ * later renewals of the same address are answered from the table.
+ *
+ * Redis stays the authority.  A renewal is only answered here while the
+ * lease in Redis has at least "margin" seconds left, so a write-back
+ * which is still queued, or in flight, lands before Redis could give the
+ * address to anyone else.  When the renewed lease outlasts the one in
+ * Redis, the caller writes it back, and the table assumes the write
+ * will succeed.  If it doesn't, the caller removes the entry, and the
+ * device's next renewal goes to Redis.
+ *
+ * Other servers using the same pools don't see the table.  A device
+ * must renew through the same server for its renewals to be answered
+ * here, as they usually are.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rbtree.h>
+#include <freeradius-devel/io/time.h>
+
+#include "lease.h"
+
+struct ippool_lease_table {
+	rbtree_t		*tree;			//!< Entries, by pool and device.
+	fr_dlist_t		lru;			//!< Entries, most recently renewed first.
+	uint32_t		count;			//!< Entries in the table.
+	uint32_t		max_entries;		//!< Least recently renewed entries are dropped
+							///< when the table is full.
+	pthread_mutex_t		mutex;			//!< Protects everything above.
+};
+
+typedef struct {
+	ippool_lease_table_t	*table;			//!< The table we're in.
+
+	uint8_t			*key;			//!< Pool name, followed by device.
+	size_t			pool_len;		//!< Length of the pool name.
+	size_t			device_len;		//!< Length of the device.
+
+	fr_ipaddr_t		ip;			//!< Address leased to the device.
+	char			*range;			//!< Range ID of the address, may be NULL.
+	uint8_t			*gateway;		//!< Gateway the device was last seen through.
+	size_t			gateway_len;		//!< Length of the gateway.
+
+	time_t			expires;		//!< When the device's lease ends.
+	time_t			stored;			//!< When the lease in Redis ends.
+
+	fr_dlist_t		entry;			//!< In the LRU list.
+} ippool_lease_entry_t;
+
+static int ippool_lease_cmp(void const *one, void const *two)
+{
+	ippool_lease_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->pool_len > b->pool_len) - (a->pool_len < b->pool_len);
+	if (ret != 0) return ret;
+
+	ret = (a->device_len > b->device_len) - (a->device_len < b->device_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->key, b->key, a->pool_len + a->device_len);
+}
+
+static int _ippool_lease_entry_free(ippool_lease_entry_t *e)
+{
+	ippool_lease_table_t *table = e->table;
+
+	rbtree_deletebydata(table->tree, e);
+	fr_dlist_remove(&e->entry);
+	table->count--;
+
+	return 0;
+}
+
+static int _ippool_lease_table_free(ippool_lease_table_t *table)
+{
+	fr_dlist_t *entry;
+
+	while ((entry = FR_DLIST_FIRST(table->lru))) {
+		talloc_free(fr_ptr_to_type(ippool_lease_entry_t, entry, entry));
+	}
+	pthread_mutex_destroy(&table->mutex);
+
+	return 0;
+}
+
+/** Allocate a lease table, shared by all workers
+ *
+ * @param[in] ctx		to allocate the table in.
+ * @param[in] max_entries	the most leases to keep.
+ * @return
+ *	- The new table.
+ *	- NULL on error.
+ */
+ippool_lease_table_t *ippool_lease_table_alloc(TALLOC_CTX *ctx, uint32_t max_entries)
+{
+	ippool_lease_table_t *table;
+
+	table = talloc_zero(ctx, ippool_lease_table_t);
+	if (!table) return NULL;
+
+	table->tree = rbtree_create(table, ippool_lease_cmp, NULL, 0);
+	if (!table->tree) {
+	error:
+		talloc_free(table);
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&table->mutex, NULL) < 0) {
+		fr_strerror_printf("Failed initializing mutex: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	FR_DLIST_INIT(table->lru);
+	table->max_entries = max_entries;
+	talloc_set_destructor(table, _ippool_lease_table_free);
+
+	return table;
+}
+
+/** Find an entry, the caller must hold the mutex
+ *
+ */
+static ippool_lease_entry_t *ippool_lease_find(ippool_lease_table_t *table, uint8_t *buff,
+					       uint8_t const *pool, size_t pool_len,
+					       uint8_t const *device, size_t device_len)
+{
+	ippool_lease_entry_t my_e;
+
+	memcpy(buff, pool, pool_len);
+	memcpy(buff + pool_len, device, device_len);
+
+	my_e.key = buff;
+	my_e.pool_len = pool_len;
+	my_e.device_len = device_len;
+
+	return rbtree_finddata(table->tree, &my_e);
+}
+
+/** Renew a device's lease, if the table has it
+ *
+ * @param[in] ctx		to allocate the range ID in "out" in.
+ * @param[out] out		a copy of the renewed lease.
+ * @param[in] table		of leases.
+ * @param[in] pool		the device's pool.
+ * @param[in] pool_len		length of the pool name.
+ * @param[in] device		being renewed.
+ * @param[in] device_len	length of the device.
+ * @param[in] ip		the device asked to renew.
+ * @param[in] gateway		the device was seen through.
+ * @param[in] gateway_len	length of the gateway.
+ * @param[in] now		the current time.
+ * @param[in] lease_time	for the device.
+ * @param[in] store_time	the caller will write to Redis, if the lease must be written back.
+ * @param[in] margin		the lease in Redis must have left, for the renewal to be answered here.
+ * @return
+ *	- IPPOOL_LEASE_MISS if the caller must send the update to Redis.
+ *	- IPPOOL_LEASE_HIT if the lease was renewed.
+ *	- IPPOOL_LEASE_WRITE if the lease was renewed, and the caller must write it back
+ *	  with "store_time".
+ */
+ippool_lease_rcode_t ippool_lease_renew(TALLOC_CTX *ctx, ippool_lease_t *out, ippool_lease_table_t *table,
+					uint8_t const *pool, size_t pool_len,
+					uint8_t const *device, size_t device_len,
+					fr_ipaddr_t const *ip, uint8_t const *gateway, size_t gateway_len,
+					time_t now, uint32_t lease_time, uint32_t store_time, uint32_t margin)
+{
+	uint8_t			buff[pool_len + device_len];
+	ippool_lease_entry_t	*e;
+	ippool_lease_rcode_t	rcode = IPPOOL_LEASE_HIT;
+
+	pthread_mutex_lock(&table->mutex);
+	e = ippool_lease_find(table, buff, pool, pool_len, device, device_len);
+	if (!e) {
+	miss:
+		pthread_mutex_unlock(&table->mutex);
+		return IPPOOL_LEASE_MISS;
+	}
+
+	/*
+	 *	The lease has run out, or the device wants
+	 *	another address.  Redis decides what happens
+	 *	next.
+	 */
+	if ((e->expires <= now) || (fr_ipaddr_cmp(&e->ip, ip) != 0)) {
+		talloc_free(e);
+		goto miss;
+	}
+
+	/*
+	 *	Redis may expire the lease before a write-back
+	 *	lands.  The update refreshes the entry.
+	 */
+	if (e->stored < (now + (time_t)margin)) goto miss;
+
+	e->expires = now + lease_time;
+
+	if ((gateway_len != e->gateway_len) || (gateway_len && (memcmp(gateway, e->gateway, gateway_len) != 0))) {
+		TALLOC_FREE(e->gateway);
+		if (gateway_len) e->gateway = talloc_memdup(e, gateway, gateway_len);
+		e->gateway_len = gateway_len;
+		rcode = IPPOOL_LEASE_WRITE;
+	}
+
+	if (e->stored < e->expires) rcode = IPPOOL_LEASE_WRITE;
+	if (rcode == IPPOOL_LEASE_WRITE) e->stored = now + store_time;
+
+	fr_dlist_remove(&e->entry);
+	fr_dlist_insert_head(&table->lru, &e->entry);
+
+	out->ip = e->ip;
+	out->range = e->range ? talloc_strdup(ctx, e->range) : NULL;
+	out->gateway = NULL;
+	out->gateway_len = 0;
+	out->expires = e->expires;
+	out->stored = e->stored;
+	pthread_mutex_unlock(&table->mutex);
+
+	return rcode;
+}
+
+/** Add a lease to the table, or replace the device's existing lease
+ *
+ * @param[in] table		of leases.
+ * @param[in] pool		the device's pool.
+ * @param[in] pool_len		length of the pool name.
+ * @param[in] device		the lease belongs to.
+ * @param[in] device_len	length of the device.
+ * @param[in] lease		as written to Redis.  Copied.
+ */
+void ippool_lease_insert(ippool_lease_table_t *table,
+			 uint8_t const *pool, size_t pool_len,
+			 uint8_t const *device, size_t device_len,
+			 ippool_lease_t const *lease)
+{
+	uint8_t			buff[pool_len + device_len];
+	ippool_lease_entry_t	*e;
+	fr_dlist_t		*tail;
+
+	pthread_mutex_lock(&table->mutex);
+	e = ippool_lease_find(table, buff, pool, pool_len, device, device_len);
+	if (e) talloc_free(e);
+
+	while ((table->count >= table->max_entries) && (tail = FR_DLIST_TAIL(table->lru))) {
+		talloc_free(fr_ptr_to_type(ippool_lease_entry_t, entry, tail));
+	}
+
+	e = talloc_zero(table, ippool_lease_entry_t);
+	if (!e) goto done;
+
+	e->table = table;
+	e->key = talloc_memdup(e, buff, pool_len + device_len);
+	e->pool_len = pool_len;
+	e->device_len = device_len;
+	e->ip = lease->ip;
+	if (lease->range) e->range = talloc_strdup(e, lease->range);
+	if (lease->gateway_len) e->gateway = talloc_memdup(e, lease->gateway, lease->gateway_len);
+	e->gateway_len = lease->gateway_len;
+	e->expires = lease->expires;
+	e->stored = lease->stored;
+
+	if (!rbtree_insert(table->tree, e)) {
+		talloc_free(e);
+		goto done;
+	}
+
+	fr_dlist_insert_head(&table->lru, &e->entry);
+	table->count++;
+	talloc_set_destructor(e, _ippool_lease_entry_free);
+
+done:
+	pthread_mutex_unlock(&table->mutex);
+}
+
+/** Remove a device's lease from the table
+ *
+ * @param[in] table		of leases.
+ * @param[in] pool		the device's pool.
+ * @param[in] pool_len		length of the pool name.
+ * @param[in] device		the lease belongs to.
+ * @param[in] device_len	length of the device.
+ */
+void ippool_lease_remove(ippool_lease_table_t *table,
+			 uint8_t const *pool, size_t pool_len,
+			 uint8_t const *device, size_t device_len)
+{
+	uint8_t			buff[pool_len + device_len];
+	ippool_lease_entry_t	*e;
+
+	pthread_mutex_lock(&table->mutex);
+	e = ippool_lease_find(table, buff, pool, pool_len, device, device_len);
+	if (e) talloc_free(e);
+	pthread_mutex_unlock(&table->mutex);
+}
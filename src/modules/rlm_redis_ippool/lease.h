@@ -0,0 +1,66 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ * @file lease.h
+ * @brief Leases known to all workers, so renewals needn't go to Redis.
+ *
+ * @copyright 2026  The FreeRADIUS server project
+ */
+#ifndef _REDIS_IPPOOL_LEASE_H
+#define	_REDIS_IPPOOL_LEASE_H
+
+RCSIDH(lease_h, "$Id$")
+
+typedef struct ippool_lease_table ippool_lease_table_t;
+
+/** What the caller should do with a renewal
+ */
+typedef enum {
+	IPPOOL_LEASE_MISS = 0,			//!< Not in the table, send the update to Redis.
+	IPPOOL_LEASE_HIT,			//!< Renewed, Redis already holds the lease for long enough.
+	IPPOOL_LEASE_WRITE			//!< Renewed, the lease must be written back to Redis.
+} ippool_lease_rcode_t;
+
+/** A copy of a lease in the table
+ */
+typedef struct {
+	fr_ipaddr_t		ip;			//!< Address leased to the device.
+	char const		*range;			//!< Range ID of the address, may be NULL.
+	uint8_t const		*gateway;		//!< Gateway the device was last seen through.
+	size_t			gateway_len;		//!< Length of the gateway.
+	time_t			expires;		//!< When the device's lease ends.
+	time_t			stored;			//!< When the lease in Redis ends.
+} ippool_lease_t;
+
+ippool_lease_table_t	*ippool_lease_table_alloc(TALLOC_CTX *ctx, uint32_t max_entries);
+
+ippool_lease_rcode_t	ippool_lease_renew(TALLOC_CTX *ctx, ippool_lease_t *out, ippool_lease_table_t *table,
+					   uint8_t const *pool, size_t pool_len,
+					   uint8_t const *device, size_t device_len,
+					   fr_ipaddr_t const *ip, uint8_t const *gateway, size_t gateway_len,
+					   time_t now, uint32_t lease_time, uint32_t store_time, uint32_t margin);
+
+void			ippool_lease_insert(ippool_lease_table_t *table,
+					    uint8_t const *pool, size_t pool_len,
+					    uint8_t const *device, size_t device_len,
+					    ippool_lease_t const *lease);
+
+void			ippool_lease_remove(ippool_lease_table_t *table,
+					    uint8_t const *pool, size_t pool_len,
+					    uint8_t const *device, size_t device_len);
+#endif /* _REDIS_IPPOOL_LEASE_H */
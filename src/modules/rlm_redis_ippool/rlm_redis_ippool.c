@@ -45,10 +45,12 @@ RCSID("$Id$")
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/io/time.h>
 
 #include "redis.h"
 #include "cluster.h"
 #include "redis_ippool.h"
+#include "lease.h"
 
 /** rlm_redis module instance
  *
@@ -93,14 +95,64 @@ typedef struct rlm_redis_ippool {
 	bool			copy_on_update; //!< Copy the address provided by ip_address to the
 						//!< allocated_address_attr if updates are successful.
 
+	bool			pipeline;	//!< Issue updates and releases asynchronously, so
+						//!< they're pipelined with those of other requests.
+
+	uint32_t		lease_max_entries;	//!< Size of the lease table, 0 disables it.
+	struct timeval		lease_writeback_interval;	//!< Longest a write-back is queued for.
+	uint32_t		lease_writeback_batch;	//!< Write-backs queued before they're sent.
+	uint32_t		lease_headroom;	//!< Extra time written back to Redis, so later
+						//!< renewals needn't be written back.
+	ippool_lease_table_t	*leases;	//!< Leases shared by all workers.
+
+	char const		*latency_xlat;	//!< Name of the allocation latency xlat.
+	struct ippool_stats	*stats;		//!< Allocation latency by pool.
+
 	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
 } rlm_redis_ippool_t;
 
+typedef struct ippool_async ippool_async_t;
+
+typedef struct rlm_redis_ippool_thread {
+	fr_redis_cluster_thread_t *cluster;	//!< Async cluster state, only used if pipeline = yes,
+						//!< or there's a lease table.
+
+	fr_event_list_t		*el;		//!< This worker's event list.
+	REQUEST			*request;	//!< Write-backs are issued as, and logged to.
+	ippool_async_t		*writeback_head;	//!< Write-backs waiting to be sent.
+	ippool_async_t		**writeback_tail;	//!< Where the next write-back goes.
+	uint32_t		writeback_count;	//!< Number of write-backs waiting.
+	fr_event_timer_t const	*writeback_ev;	//!< When the oldest write-back has waited long enough.
+} rlm_redis_ippool_thread_t;
+
+/** Allocation latency for a single pool
+ */
+typedef struct ippool_latency {
+	uint8_t const		*pool;		//!< Pool name.
+	size_t			pool_len;	//!< Length of the pool name.
+
+	uint64_t		count;		//!< Number of allocations timed.
+	uint64_t		avg;		//!< Moving average of allocation latency (microseconds).
+} ippool_latency_t;
+
+typedef struct ippool_stats {
+	rbtree_t		*pools;		//!< #ippool_latency_t by pool name.
+	pthread_mutex_t		mutex;		//!< Protects pools.
+} ippool_stats_t;
+
 static CONF_PARSER redis_config[] = {
 	REDIS_COMMON_CONFIG,
 	CONF_PARSER_TERMINATOR
 };
 
+static CONF_PARSER lease_table_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_redis_ippool_t, lease_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("writeback_interval", FR_TYPE_TIMEVAL, rlm_redis_ippool_t, lease_writeback_interval), .dflt = "1.0" },
+	{ FR_CONF_OFFSET("writeback_batch", FR_TYPE_UINT32, rlm_redis_ippool_t, lease_writeback_batch), .dflt = "100" },
+	{ FR_CONF_OFFSET("headroom", FR_TYPE_UINT32, rlm_redis_ippool_t, lease_headroom), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("pool_name", FR_TYPE_TMPL | FR_TYPE_REQUIRED, rlm_redis_ippool_t, pool_name) },
 
@@ -125,6 +177,10 @@ static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("ipv4_integer", FR_TYPE_BOOL, rlm_redis_ippool_t, ipv4_integer) },
 	{ FR_CONF_OFFSET("copy_on_update", FR_TYPE_BOOL, rlm_redis_ippool_t, copy_on_update), .dflt = "yes", .quote = T_BARE_WORD },
 
+	{ FR_CONF_OFFSET("pipeline", FR_TYPE_BOOL, rlm_redis_ippool_t, pipeline), .dflt = "no" },
+
+	{ FR_CONF_POINTER("lease_table", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) lease_table_config },
+
 	/*
 	 *	Split out to allow conversion to universal ippool module with
 	 *	minimum of config changes.
@@ -755,6 +811,126 @@ finish:
 	return ret;
 }
 
+/** Write the range ID of a lease to range_attr
+ *
+ * @param[in] inst	This instance of the rlm_redis_ippool module.
+ * @param[in] request	The current request.
+ * @param[in] range	ID of the range the address belongs to.
+ * @param[in] len	Length of the range ID.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int ippool_reply_range(rlm_redis_ippool_t const *inst, REQUEST *request, char const *range, size_t len)
+{
+	vp_tmpl_t		range_rhs = { .name = "", .type = TMPL_TYPE_DATA, .tmpl_value_type = FR_TYPE_STRING, .quote = T_DOUBLE_QUOTED_STRING };
+	vp_map_t		range_map = { .lhs = inst->range_attr, .op = T_OP_SET, .rhs = &range_rhs };
+
+	range_map.rhs->tmpl_value.vb_strvalue = range;
+	range_map.rhs->tmpl_value_length = len;
+	range_map.rhs->tmpl_value_type = FR_TYPE_STRING;
+
+	return map_to_request(request, &range_map, map_to_vp, NULL);
+}
+
+/** Copy the lease time to expiry_attr (if set)
+ *
+ * @param[in] inst	This instance of the rlm_redis_ippool module.
+ * @param[in] request	The current request.
+ * @param[in] expires	Lease time.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int ippool_reply_expiry(rlm_redis_ippool_t const *inst, REQUEST *request, uint32_t expires)
+{
+	vp_tmpl_t expiry_rhs = {
+		.name = "",
+		.type = TMPL_TYPE_DATA,
+		.tmpl_value_type = FR_TYPE_STRING,
+		.quote = T_DOUBLE_QUOTED_STRING
+	};
+	vp_map_t expiry_map = {
+		.lhs = inst->expiry_attr,
+		.op = T_OP_SET,
+		.rhs = &expiry_rhs
+	};
+
+	if (!inst->expiry_attr) return 0;
+
+	expiry_map.rhs->tmpl_value.vb_uint32 = expires;
+	expiry_map.rhs->tmpl_value_type = FR_TYPE_UINT32;
+
+	return map_to_request(request, &expiry_map, map_to_vp, NULL);
+}
+
+/** Process the result of the update script
+ *
+ * @param[in] inst	This instance of the rlm_redis_ippool module.
+ * @param[in] request	The current request.
+ * @param[in] reply	to the update script.
+ * @param[in] expires	Lease time the update was performed with.
+ * @return the result code of the script, or IPPOOL_RCODE_FAIL.
+ */
+static ippool_rcode_t ippool_update_reply(rlm_redis_ippool_t const *inst, REQUEST *request,
+					  redisReply *reply, uint32_t expires)
+{
+	ippool_rcode_t		ret;
+
+	if (reply->type != REDIS_REPLY_ARRAY) {
+		REDEBUG("Expected result to be array got \"%s\"",
+			fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
+		return IPPOOL_RCODE_FAIL;
+	}
+
+	if (reply->elements == 0) {
+		REDEBUG("Got empty result array");
+		return IPPOOL_RCODE_FAIL;
+	}
+
+	/*
+	 *	Process return code
+	 */
+	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
+		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
+			fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
+		return IPPOOL_RCODE_FAIL;
+	}
+	ret = reply->element[0]->integer;
+	if (ret < 0) return ret;
+
+	/*
+	 *	Process Range identifier
+	 */
+	if (reply->elements > 1) {
+		switch (reply->element[1]->type) {
+		/*
+		 *	Add range ID to request
+		 */
+		case REDIS_REPLY_STRING:
+			if (ippool_reply_range(inst, request, reply->element[1]->str, reply->element[1]->len) < 0) {
+				return IPPOOL_RCODE_FAIL;
+			}
+			break;
+
+		case REDIS_REPLY_NIL:
+			break;
+
+		default:
+			REDEBUG("Server returned unexpected type \"%s\" for range element (result[1])",
+				fr_int2str(redis_reply_types, reply->element[0]->type, "<UNKNOWN>"));
+			return IPPOOL_RCODE_FAIL;
+		}
+	}
+
+	/*
+	 *	Copy expiry time to expires attribute (if set)
+	 */
+	if (ippool_reply_expiry(inst, request, expires) < 0) return IPPOOL_RCODE_FAIL;
+
+	return ret;
+}
+
 /** Update an existing IP address in a pool
  *
  */
@@ -771,9 +947,6 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUES
 	fr_redis_rcode_t	status;
 	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
 
-	vp_tmpl_t		range_rhs = { .name = "", .type = TMPL_TYPE_DATA, .tmpl_value_type = FR_TYPE_STRING, .quote = T_DOUBLE_QUOTED_STRING };
-	vp_map_t		range_map = { .lhs = inst->range_attr, .op = T_OP_SET, .rhs = &range_rhs };
-
 	gettimeofday(&now, NULL);
 
 	/*
@@ -815,17 +988,31 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUES
 		goto finish;
 	}
 
+	ret = ippool_update_reply(inst, request, reply, expires);
+
+finish:
+	fr_redis_reply_free(reply);
+
+	return ret;
+}
+
+/** Process the result of the release script
+ *
+ * @param[in] request	The current request.
+ * @param[in] reply	to the release script.
+ * @return the result code of the script, or IPPOOL_RCODE_FAIL.
+ */
+static ippool_rcode_t ippool_release_reply(REQUEST *request, redisReply *reply)
+{
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
 			fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 
 	if (reply->elements == 0) {
 		REDEBUG("Got empty result array");
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 
 	/*
@@ -834,69 +1021,9 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUES
 	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
 		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
 			fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
-	ret = reply->element[0]->integer;
-	if (ret < 0) goto finish;
-
-	/*
-	 *	Process Range identifier
-	 */
-	if (reply->elements > 1) {
-		switch (reply->element[1]->type) {
-		/*
-		 *	Add range ID to request
-		 */
-		case REDIS_REPLY_STRING:
-			range_map.rhs->tmpl_value.vb_strvalue = reply->element[1]->str;
-			range_map.rhs->tmpl_value_length = reply->element[1]->len;
-			range_map.rhs->tmpl_value_type = FR_TYPE_STRING;
-			if (map_to_request(request, &range_map, map_to_vp, NULL) < 0) {
-				ret = IPPOOL_RCODE_FAIL;
-				goto finish;
-			}
-			break;
-
-		case REDIS_REPLY_NIL:
-			break;
-
-		default:
-			REDEBUG("Server returned unexpected type \"%s\" for range element (result[1])",
-				fr_int2str(redis_reply_types, reply->element[0]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
-		}
-	}
-
-	/*
-	 *	Copy expiry time to expires attribute (if set)
-	 */
-	if (inst->expiry_attr) {
-		vp_tmpl_t expiry_rhs = {
-			.name = "",
-			.type = TMPL_TYPE_DATA,
-			.tmpl_value_type = FR_TYPE_STRING,
-			.quote = T_DOUBLE_QUOTED_STRING
-		};
-		vp_map_t expiry_map = {
-			.lhs = inst->expiry_attr,
-			.op = T_OP_SET,
-			.rhs = &expiry_rhs
-		};
-
-		expiry_map.rhs->tmpl_value.vb_uint32 = expires;
-		expiry_map.rhs->tmpl_value_type = FR_TYPE_UINT32;
-		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) {
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
-		}
-	}
-
-finish:
-	fr_redis_reply_free(reply);
-
-	return ret;
+	return reply->element[0]->integer;
 }
 
 /** Release an existing IP address in a pool
@@ -951,30 +1078,7 @@ static ippool_rcode_t redis_ippool_release(rlm_redis_ippool_t const *inst, REQUE
 		goto finish;
 	}
 
-	if (reply->type != REDIS_REPLY_ARRAY) {
-		REDEBUG("Expected result to be array got \"%s\"",
-			fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	if (reply->elements == 0) {
-		REDEBUG("Got empty result array");
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	/*
-	 *	Process return code
-	 */
-	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
-		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
-			fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-	ret = reply->element[0]->integer;
-	if (ret < 0) goto finish;
+	ret = ippool_release_reply(request, reply);
 
 finish:
 	fr_redis_reply_free(reply);
@@ -1021,7 +1125,544 @@ static inline ssize_t ippool_pool_name(uint8_t const **out, uint8_t buff[], size
 	return slen;
 }
 
-static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request, ippool_action_t action)
+/** Record how long an allocation took
+ *
+ * Keeps a moving average per pool, so slow pools can be identified
+ * with the %{<inst>_latency:<pool>} xlat.
+ */
+static void ippool_latency_update(rlm_redis_ippool_t const *inst, uint8_t const *pool, size_t pool_len,
+				  fr_time_t elapsed)
+{
+	ippool_stats_t		*stats = inst->stats;
+	ippool_latency_t	find = { .pool = pool, .pool_len = pool_len }, *found;
+	uint64_t		usec = elapsed / 1000;
+
+	pthread_mutex_lock(&stats->mutex);
+	found = rbtree_finddata(stats->pools, &find);
+	if (!found) {
+		MEM(found = talloc_zero(stats, ippool_latency_t));
+		found->pool = talloc_memdup(found, pool, pool_len);
+		found->pool_len = pool_len;
+		if (!rbtree_insert(stats->pools, found)) {
+			talloc_free(found);
+			pthread_mutex_unlock(&stats->mutex);
+			return;
+		}
+	}
+
+	/*
+	 *	Exponentially weighted, with newer samples
+	 *	accounting for 1/8th of the average.
+	 */
+	if (found->count++ == 0) {
+		found->avg = usec;
+	} else {
+		found->avg = found->avg - (found->avg >> 3) + (usec >> 3);
+	}
+	pthread_mutex_unlock(&stats->mutex);
+}
+
+static int ippool_latency_cmp(void const *a, void const *b)
+{
+	ippool_latency_t const *my_a = a, *my_b = b;
+	int ret;
+
+	ret = memcmp(my_a->pool, my_b->pool, my_a->pool_len < my_b->pool_len ? my_a->pool_len : my_b->pool_len);
+	if (ret != 0) return ret;
+
+	return (my_a->pool_len > my_b->pool_len) - (my_a->pool_len < my_b->pool_len);
+}
+
+/** Return the average allocation latency for a pool, in microseconds
+ *
+ * Example:
+@verbatim
+"%{redis_ippool_latency:local}" == "312"
+@endverbatim
+ */
+static ssize_t ippool_latency_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
+				   void const *mod_inst, UNUSED void const *xlat_inst,
+				   UNUSED REQUEST *request, char const *fmt)
+{
+	rlm_redis_ippool_t const	*inst = mod_inst;
+	ippool_stats_t			*stats = inst->stats;
+	ippool_latency_t		find = { .pool = (uint8_t const *)fmt, .pool_len = strlen(fmt) }, *found;
+	uint64_t			avg = 0;
+
+	pthread_mutex_lock(&stats->mutex);
+	found = rbtree_finddata(stats->pools, &find);
+	if (found) avg = found->avg;
+	pthread_mutex_unlock(&stats->mutex);
+
+	return snprintf(*out, outlen, "%" PRIu64, avg);
+}
+
+/** Convert the result of an update into a module rcode
+ *
+ * @param[in] inst	This instance of the rlm_redis_ippool module.
+ * @param[in] request	The current request.
+ * @param[in] ret	Result of the update script.
+ * @param[in] ip_str	Address that was updated.
+ * @return the module rcode.
+ */
+static rlm_rcode_t ippool_update_rcode(rlm_redis_ippool_t const *inst, REQUEST *request,
+				       ippool_rcode_t ret, char const *ip_str)
+{
+	switch (ret) {
+	case IPPOOL_RCODE_SUCCESS:
+		RDEBUG2("Requested IP address' \"%s\" lease updated", ip_str);
+
+		/*
+		 *	Copy over the input IP address to the reply attribute
+		 */
+		if (inst->copy_on_update) {
+			vp_tmpl_t ip_rhs = {
+				.name = "",
+				.type = TMPL_TYPE_DATA,
+				.quote = T_BARE_WORD,
+			};
+			vp_map_t ip_map = {
+				.lhs = inst->allocated_address_attr,
+				.op = T_OP_SET,
+				.rhs = &ip_rhs
+			};
+
+			ip_rhs.tmpl_value_length = strlen(ip_str);
+			ip_rhs.tmpl_value.vb_strvalue = ip_str;
+			ip_rhs.tmpl_value_type = FR_TYPE_STRING;
+
+			if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) return RLM_MODULE_FAIL;
+		}
+		return RLM_MODULE_UPDATED;
+
+	/*
+	 *	It's useful to be able to identify the 'not found' case
+	 *	as we can relay to a server where the IP address might
+	 *	be found.  This extremely useful for migrations.
+	 */
+	case IPPOOL_RCODE_NOT_FOUND:
+		REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
+		return RLM_MODULE_NOTFOUND;
+
+	case IPPOOL_RCODE_EXPIRED:
+		REDEBUG("Requested IP address' \"%s\" lease already expired at time of renewal", ip_str);
+		return RLM_MODULE_INVALID;
+
+	case IPPOOL_RCODE_DEVICE_MISMATCH:
+		REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
+		return RLM_MODULE_INVALID;
+
+	default:
+		return RLM_MODULE_FAIL;
+	}
+}
+
+/** Convert the result of a release into a module rcode
+ *
+ * @param[in] request	The current request.
+ * @param[in] ret	Result of the release script.
+ * @param[in] ip_str	Address that was released.
+ * @return the module rcode.
+ */
+static rlm_rcode_t ippool_release_rcode(REQUEST *request, ippool_rcode_t ret, char const *ip_str)
+{
+	switch (ret) {
+	case IPPOOL_RCODE_SUCCESS:
+		RDEBUG2("IP address \"%s\" released", ip_str);
+		return RLM_MODULE_UPDATED;
+
+	/*
+	 *	It's useful to be able to identify the 'not found' case
+	 *	as we can relay to a server where the IP address might
+	 *	be found.  This extremely useful for migrations.
+	 */
+	case IPPOOL_RCODE_NOT_FOUND:
+		REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
+		return RLM_MODULE_NOTFOUND;
+
+	case IPPOOL_RCODE_DEVICE_MISMATCH:
+		REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
+		return RLM_MODULE_INVALID;
+
+	default:
+		return RLM_MODULE_FAIL;
+	}
+}
+
+#define IPPOOL_ASYNC_MAX_ARGS	9
+
+/*
+ *	Where the pool and device are in the arguments
+ *	of an update or a release.
+ */
+#define IPPOOL_ASYNC_ARG_POOL	3
+#define IPPOOL_ASYNC_ARG_DEVICE(_action)	((_action) == POOL_ACTION_UPDATE ? 7 : 6)
+
+/** State for an update or release issued through the async cluster client
+ */
+struct ippool_async {
+	rlm_redis_ippool_t const	*inst;		//!< This instance of the module.
+	rlm_redis_ippool_thread_t	*t;		//!< Thread the command was issued from.
+
+	ippool_action_t			action;		//!< #POOL_ACTION_UPDATE or #POOL_ACTION_RELEASE.
+	fr_ipaddr_t			ip;		//!< Address being updated or released.
+	char const			*ip_str;	//!< Address being updated or released.
+	uint32_t			expires;	//!< Lease time for updates.
+
+	bool				writeback;	//!< Writes back a lease renewed from the lease table.
+							///< Not issued for any request.
+	ippool_async_t			*next;		//!< Next write-back waiting to be sent.
+
+	fr_redis_cluster_async_t	*cmd;		//!< Command in flight, NULL once the reply is received.
+	bool				eval;		//!< Whether we've already fallen back to EVAL.
+
+	int				argc;		//!< Number of arguments.
+	char const			*argv[IPPOOL_ASYNC_MAX_ARGS];	//!< Arguments, argv[1] is the digest.
+	size_t				argv_len[IPPOOL_ASYNC_MAX_ARGS];	//!< Length of each argument.
+
+	ippool_rcode_t			ret;		//!< Result of the script.
+};
+
+/** Append an argument to the command in an #ippool_async_t
+ *
+ */
+static void ippool_async_arg(ippool_async_t *state, void const *arg, size_t len)
+{
+	char *p;
+
+	rad_assert(state->argc < IPPOOL_ASYNC_MAX_ARGS);
+
+	MEM(p = talloc_array(state, char, len + 1));
+	memcpy(p, arg, len);
+	p[len] = '\0';
+
+	state->argv[state->argc] = p;
+	state->argv_len[state->argc++] = len;
+}
+
+static int ippool_async_send(REQUEST *request, ippool_async_t *state);
+
+/** Drop a lease from the lease table, if a write-back of it failed
+ *
+ * The table assumed the write-back would succeed.  Without the entry,
+ * the device's next renewal goes to Redis, which has the final say.
+ */
+static void ippool_writeback_done(REQUEST *request, ippool_async_t *state)
+{
+	int device = IPPOOL_ASYNC_ARG_DEVICE(state->action);
+
+	if (state->ret != IPPOOL_RCODE_SUCCESS) {
+		RWARN("Failed writing back lease of \"%s\", removing it from the lease table", state->ip_str);
+		ippool_lease_remove(state->inst->leases,
+				    (uint8_t const *)state->argv[IPPOOL_ASYNC_ARG_POOL],
+				    state->argv_len[IPPOOL_ASYNC_ARG_POOL],
+				    (uint8_t const *)state->argv[device], state->argv_len[device]);
+	}
+
+	talloc_free(state);
+}
+
+/** Process the reply to a pipelined update or release
+ *
+ */
+static void _ippool_async_reply(REQUEST *request, fr_redis_rcode_t status, redisReply *reply, void *uctx)
+{
+	ippool_async_t	*state = uctx;
+
+	state->cmd = NULL;
+	state->ret = IPPOOL_RCODE_FAIL;
+
+	/*
+	 *	The node lost its script cache, send the full
+	 *	script instead, which will also load it.
+	 */
+	if ((status == REDIS_RCODE_NO_SCRIPT) && !state->eval) {
+		char const *script = (state->action == POOL_ACTION_UPDATE) ? lua_update_cmd : lua_release_cmd;
+
+		RDEBUG3("Script not loaded, falling back to EVAL");
+		state->eval = true;
+		state->argv[0] = "EVAL";
+		state->argv_len[0] = sizeof("EVAL") - 1;
+		state->argv[1] = script;
+		state->argv_len[1] = strlen(script);
+
+		if (ippool_async_send(request, state) == 0) return;
+		goto finish;
+	}
+
+	if ((status != REDIS_RCODE_SUCCESS) || !rad_cond_assert(reply)) goto finish;
+
+	/*
+	 *	Nothing to write the range or lease time to,
+	 *	the renewal was answered from the lease table.
+	 */
+	if (state->writeback) {
+		if ((reply->type == REDIS_REPLY_ARRAY) && (reply->elements > 0) &&
+		    (reply->element[0]->type == REDIS_REPLY_INTEGER)) state->ret = reply->element[0]->integer;
+		goto finish;
+	}
+
+	if (state->action == POOL_ACTION_UPDATE) {
+		state->ret = ippool_update_reply(state->inst, request, reply, state->expires);
+	} else {
+		state->ret = ippool_release_reply(request, reply);
+	}
+
+finish:
+	if (state->writeback) {
+		ippool_writeback_done(request, state);
+		return;
+	}
+
+	unlang_resumable(request);
+}
+
+/** Issue the command in an #ippool_async_t, keyed on the pool name
+ *
+ */
+static int ippool_async_send(REQUEST *request, ippool_async_t *state)
+{
+	state->cmd = fr_redis_cluster_async_command(state->t->cluster, request,
+						    (uint8_t const *)state->argv[IPPOOL_ASYNC_ARG_POOL],
+						    state->argv_len[IPPOOL_ASYNC_ARG_POOL], false,
+						    state->argc, state->argv, state->argv_len,
+						    _ippool_async_reply, state);
+	if (!state->cmd) {
+		RPERROR("Failed issuing script");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Keep a lease which was just updated in Redis in the lease table
+ *
+ * The range ID is read back from range_attr, where the update put it.
+ * If the update failed, the device's entry is removed.
+ */
+static void ippool_lease_update(rlm_redis_ippool_t const *inst, REQUEST *request, rlm_rcode_t rcode,
+				uint8_t const *key_prefix, size_t key_prefix_len,
+				fr_ipaddr_t const *ip,
+				uint8_t const *device_id, size_t device_id_len,
+				uint8_t const *gateway_id, size_t gateway_id_len,
+				uint32_t expires)
+{
+	ippool_lease_t	lease = {
+				.ip = *ip,
+				.gateway = gateway_id,
+				.gateway_len = gateway_id_len
+			};
+	VALUE_PAIR	*vp;
+
+	if (!inst->leases || (device_id_len == 0)) return;
+
+	if (rcode != RLM_MODULE_UPDATED) {
+		ippool_lease_remove(inst->leases, key_prefix, key_prefix_len, device_id, device_id_len);
+		return;
+	}
+
+	if ((tmpl_find_vp(&vp, request, inst->range_attr) == 0) &&
+	    (vp->vp_type == FR_TYPE_STRING)) lease.range = vp->vp_strvalue;
+
+	lease.expires = lease.stored = time(NULL) + expires;
+
+	ippool_lease_insert(inst->leases, key_prefix, key_prefix_len, device_id, device_id_len, &lease);
+}
+
+static rlm_rcode_t mod_action_resume(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx)
+{
+	ippool_async_t	*state = ctx;
+	rlm_rcode_t	rcode;
+	int		device = IPPOOL_ASYNC_ARG_DEVICE(state->action);
+
+	if (state->action == POOL_ACTION_UPDATE) {
+		rcode = ippool_update_rcode(state->inst, request, state->ret, state->ip_str);
+		ippool_lease_update(state->inst, request, rcode,
+				    (uint8_t const *)state->argv[IPPOOL_ASYNC_ARG_POOL],
+				    state->argv_len[IPPOOL_ASYNC_ARG_POOL], &state->ip,
+				    (uint8_t const *)state->argv[device], state->argv_len[device],
+				    (uint8_t const *)state->argv[device + 1], state->argv_len[device + 1],
+				    state->expires);
+	} else {
+		rcode = ippool_release_rcode(request, state->ret, state->ip_str);
+	}
+	talloc_free(state);
+
+	return rcode;
+}
+
+static void mod_action_signal(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+			      void *ctx, fr_state_action_t action)
+{
+	ippool_async_t	*state = ctx;
+
+	if (action != FR_ACTION_DONE) return;
+
+	if (state->cmd) {
+		fr_redis_cluster_async_cancel(state->cmd);
+		state->cmd = NULL;
+	}
+}
+
+/** Build an update or release for the async cluster client
+ *
+ */
+static ippool_async_t *ippool_async_alloc(TALLOC_CTX *ctx, rlm_redis_ippool_t const *inst,
+					  rlm_redis_ippool_thread_t *t, ippool_action_t action,
+					  uint8_t const *key_prefix, size_t key_prefix_len,
+					  fr_ipaddr_t *ip, char const *ip_str,
+					  uint8_t const *device_id, size_t device_id_len,
+					  uint8_t const *gateway_id, size_t gateway_id_len,
+					  uint32_t expires)
+{
+	ippool_async_t	*state;
+	char		buff[FR_IPADDR_PREFIX_STRLEN];
+	char const	*digest = (action == POOL_ACTION_UPDATE) ? lua_update_digest : lua_release_digest;
+	size_t		len;
+
+	MEM(state = talloc_zero(ctx, ippool_async_t));
+	state->inst = inst;
+	state->t = t;
+	state->action = action;
+	state->expires = expires;
+	state->ip = *ip;
+	state->ip_str = talloc_strdup(state, ip_str);
+
+	ippool_async_arg(state, "EVALSHA", sizeof("EVALSHA") - 1);
+	ippool_async_arg(state, digest, strlen(digest));
+	ippool_async_arg(state, "1", 1);
+	ippool_async_arg(state, key_prefix, key_prefix_len);
+
+	len = snprintf(buff, sizeof(buff), "%u", (unsigned int)time(NULL));
+	ippool_async_arg(state, buff, len);
+
+	if (action == POOL_ACTION_UPDATE) {
+		len = snprintf(buff, sizeof(buff), "%u", expires);
+		ippool_async_arg(state, buff, len);
+	}
+
+	if ((ip->af == AF_INET) && inst->ipv4_integer) {
+		len = snprintf(buff, sizeof(buff), "%u", htonl(ip->addr.v4.s_addr));
+	} else {
+		IPPOOL_SPRINT_IP(buff, ip, ip->prefix);
+		len = strlen(buff);
+	}
+	ippool_async_arg(state, buff, len);
+
+	/*
+	 *	hiredis doesn't deal well with NULL string pointers
+	 */
+	ippool_async_arg(state, device_id ? device_id : (uint8_t const *)"", device_id_len);
+	if (action == POOL_ACTION_UPDATE) {
+		ippool_async_arg(state, gateway_id ? gateway_id : (uint8_t const *)"", gateway_id_len);
+	}
+
+	return state;
+}
+
+/** Issue an update or release through the async cluster client
+ *
+ * Commands issued by different requests in the same pass of the event loop
+ * are written to each node together, so they share a single round trip.
+ *
+ * @note Doesn't support waiting for slaves to acknowledge the write.
+ */
+static rlm_rcode_t ippool_async_start(rlm_redis_ippool_t const *inst, rlm_redis_ippool_thread_t *t,
+				      REQUEST *request, ippool_action_t action,
+				      uint8_t const *key_prefix, size_t key_prefix_len,
+				      fr_ipaddr_t *ip, char const *ip_str,
+				      uint8_t const *device_id, size_t device_id_len,
+				      uint8_t const *gateway_id, size_t gateway_id_len,
+				      uint32_t expires)
+{
+	ippool_async_t	*state;
+
+	state = ippool_async_alloc(request, inst, t, action, key_prefix, key_prefix_len, ip, ip_str,
+				   device_id, device_id_len, gateway_id, gateway_id_len, expires);
+	if (ippool_async_send(request, state) < 0) {
+		talloc_free(state);
+		return RLM_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, mod_action_resume, mod_action_signal, state);
+}
+
+/** Send all of this worker's queued write-backs
+ *
+ * They're written to each node together, so a batch costs one round
+ * trip per node, and no request waits for it.
+ */
+static void ippool_writeback_flush(rlm_redis_ippool_thread_t *t)
+{
+	ippool_async_t	*state, *next;
+	REQUEST		*request = t->request;
+
+	if (t->writeback_ev) (void) fr_event_timer_delete(t->el, &t->writeback_ev);
+
+	state = t->writeback_head;
+	t->writeback_head = NULL;
+	t->writeback_tail = &t->writeback_head;
+	t->writeback_count = 0;
+
+	for (; state; state = next) {
+		next = state->next;
+		state->next = NULL;
+
+		if (ippool_async_send(request, state) < 0) ippool_writeback_done(request, state);
+	}
+}
+
+static void _ippool_writeback_timeout(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	rlm_redis_ippool_thread_t *t = uctx;
+
+	t->writeback_ev = NULL;
+	ippool_writeback_flush(t);
+}
+
+/** Queue the write-back of a lease renewed from the lease table
+ *
+ * The batch is sent when it's full, or when the oldest write-back in
+ * it has waited for writeback_interval.
+ */
+static void ippool_writeback_queue(rlm_redis_ippool_t const *inst, rlm_redis_ippool_thread_t *t, REQUEST *request,
+				   uint8_t const *key_prefix, size_t key_prefix_len,
+				   fr_ipaddr_t *ip, char const *ip_str,
+				   uint8_t const *device_id, size_t device_id_len,
+				   uint8_t const *gateway_id, size_t gateway_id_len,
+				   uint32_t expires)
+{
+	ippool_async_t	*state;
+	struct timeval	now, when;
+
+	state = ippool_async_alloc(t->request, inst, t, POOL_ACTION_UPDATE, key_prefix, key_prefix_len, ip, ip_str,
+				   device_id, device_id_len, gateway_id, gateway_id_len, expires);
+	state->writeback = true;
+
+	*t->writeback_tail = state;
+	t->writeback_tail = &state->next;
+
+	if (++t->writeback_count >= inst->lease_writeback_batch) {
+		ippool_writeback_flush(t);
+		return;
+	}
+
+	if (!t->writeback_ev) {
+		gettimeofday(&now, NULL);
+		fr_timeval_add(&when, &now, &inst->lease_writeback_interval);
+
+		if (fr_event_timer_insert(t, t->el, &t->writeback_ev, &when, _ippool_writeback_timeout, t) < 0) {
+			RPEDEBUG("Failed inserting write-back timer");
+			ippool_writeback_flush(t);
+			return;
+		}
+	}
+
+	RDEBUG3("Lease write-back queued, %u waiting", t->writeback_count);
+}
+
+static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, rlm_redis_ippool_thread_t *t,
+			      REQUEST *request, ippool_action_t action)
 {
 	uint8_t		key_prefix_buff[IPPOOL_MAX_KEY_PREFIX_SIZE], device_id_buff[256], gateway_id_buff[256];
 	uint8_t const	*key_prefix, *device_id = NULL, *gateway_id = NULL;
@@ -1032,6 +1673,9 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request,
 	char const	*expires_str;
 	unsigned long	expires = 0;
 	char		*q;
+	fr_time_t	start;
+	ippool_rcode_t	ret;
+	rlm_rcode_t	rcode;
 
 	slen = ippool_pool_name(&key_prefix, (uint8_t *)&key_prefix_buff, sizeof(key_prefix_len), inst, request);
 	if (slen < 0) return RLM_MODULE_FAIL;
@@ -1077,9 +1721,13 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request,
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len, NULL,
 				    device_id, device_id_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_allocate(inst, request, key_prefix, key_prefix_len,
-					      device_id, device_id_len,
-					      gateway_id, gateway_id_len, (uint32_t)expires)) {
+		start = fr_time();
+		ret = redis_ippool_allocate(inst, request, key_prefix, key_prefix_len,
+					    device_id, device_id_len,
+					    gateway_id, gateway_id_len, (uint32_t)expires);
+		ippool_latency_update(inst, key_prefix, key_prefix_len, fr_time() - start);
+
+		switch (ret) {
 		case IPPOOL_RCODE_SUCCESS:
 			RDEBUG2("IP address lease allocated");
 			return RLM_MODULE_UPDATED;
@@ -1121,55 +1769,55 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request,
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
 				    ip_str, device_id, device_id_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_update(inst, request, key_prefix, key_prefix_len,
-					    &ip, device_id, device_id_len,
-					    gateway_id, gateway_id_len, (uint32_t)expires)) {
-		case IPPOOL_RCODE_SUCCESS:
-			RDEBUG2("Requested IP address' \"%s\" lease updated", ip_str);
-
-			/*
-			 *	Copy over the input IP address to the reply attribute
-			 */
-			if (inst->copy_on_update) {
-				vp_tmpl_t ip_rhs = {
-					.name = "",
-					.type = TMPL_TYPE_DATA,
-					.quote = T_BARE_WORD,
-				};
-				vp_map_t ip_map = {
-					.lhs = inst->allocated_address_attr,
-					.op = T_OP_SET,
-					.rhs = &ip_rhs
-				};
-
-				ip_rhs.tmpl_value_length = strlen(ip_str);
-				ip_rhs.tmpl_value.vb_strvalue = ip_str;
-				ip_rhs.tmpl_value_type = FR_TYPE_STRING;
-
-				if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) return RLM_MODULE_FAIL;
-			}
-			return RLM_MODULE_UPDATED;
 
 		/*
-		 *	It's useful to be able to identify the 'not found' case
-		 *	as we can relay to a server where the IP address might
-		 *	be found.  This extremely useful for migrations.
+		 *	Routine renewals are answered from the lease
+		 *	table.  The lease in Redis must outlast any
+		 *	write-back we queue, which takes at most
+		 *	writeback_interval (rounded up), plus the
+		 *	write itself.
 		 */
-		case IPPOOL_RCODE_NOT_FOUND:
-			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
-			return RLM_MODULE_NOTFOUND;
+		if (inst->leases && (device_id_len > 0)) {
+			ippool_lease_t	lease;
+			uint32_t	store_time = (uint32_t)expires + inst->lease_headroom;
+
+			switch (ippool_lease_renew(request, &lease, inst->leases, key_prefix, key_prefix_len,
+						   device_id, device_id_len, &ip, gateway_id, gateway_id_len,
+						   time(NULL), (uint32_t)expires, store_time,
+						   (uint32_t)inst->lease_writeback_interval.tv_sec + 2)) {
+			case IPPOOL_LEASE_MISS:
+				break;
+
+			case IPPOOL_LEASE_WRITE:
+				ippool_writeback_queue(inst, t, request, key_prefix, key_prefix_len, &ip, ip_str,
+						       device_id, device_id_len, gateway_id, gateway_id_len, store_time);
+				/* FALL-THROUGH */
+
+			case IPPOOL_LEASE_HIT:
+				RDEBUG2("Lease renewed from the lease table");
+				if (lease.range &&
+				    (ippool_reply_range(inst, request, lease.range, strlen(lease.range)) < 0)) {
+					return RLM_MODULE_FAIL;
+				}
+				if (ippool_reply_expiry(inst, request, (uint32_t)expires) < 0) return RLM_MODULE_FAIL;
+
+				return ippool_update_rcode(inst, request, IPPOOL_RCODE_SUCCESS, ip_str);
+			}
+		}
 
-		case IPPOOL_RCODE_EXPIRED:
-			REDEBUG("Requested IP address' \"%s\" lease already expired at time of renewal", ip_str);
-			return RLM_MODULE_INVALID;
+		if (inst->pipeline) return ippool_async_start(inst, t, request, action, key_prefix, key_prefix_len,
+							      &ip, ip_str, device_id, device_id_len,
+							      gateway_id, gateway_id_len, (uint32_t)expires);
 
-		case IPPOOL_RCODE_DEVICE_MISMATCH:
-			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
-			return RLM_MODULE_INVALID;
+		rcode = ippool_update_rcode(inst, request,
+					    redis_ippool_update(inst, request, key_prefix, key_prefix_len,
+								&ip, device_id, device_id_len,
+								gateway_id, gateway_id_len, (uint32_t)expires),
+					    ip_str);
+		ippool_lease_update(inst, request, rcode, key_prefix, key_prefix_len, &ip,
+				    device_id, device_id_len, gateway_id, gateway_id_len, (uint32_t)expires);
 
-		default:
-			return RLM_MODULE_FAIL;
-		}
+		return rcode;
 	}
 
 	case POOL_ACTION_RELEASE:
@@ -1189,28 +1837,18 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request,
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
 				    ip_str, device_id, device_id_len, gateway_id, gateway_id_len, 0);
-		switch (redis_ippool_release(inst, request, key_prefix, key_prefix_len,
-					     &ip, device_id, device_id_len)) {
-		case IPPOOL_RCODE_SUCCESS:
-			RDEBUG2("IP address \"%s\" released", ip_str);
-			return RLM_MODULE_UPDATED;
-
-		/*
-		 *	It's useful to be able to identify the 'not found' case
-		 *	as we can relay to a server where the IP address might
-		 *	be found.  This extremely useful for migrations.
-		 */
-		case IPPOOL_RCODE_NOT_FOUND:
-			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
-			return RLM_MODULE_NOTFOUND;
+		if (inst->leases && (device_id_len > 0)) {
+			ippool_lease_remove(inst->leases, key_prefix, key_prefix_len, device_id, device_id_len);
+		}
 
-		case IPPOOL_RCODE_DEVICE_MISMATCH:
-			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
-			return RLM_MODULE_INVALID;
+		if (inst->pipeline) return ippool_async_start(inst, t, request, action, key_prefix, key_prefix_len,
+							      &ip, ip_str, device_id, device_id_len,
+							      NULL, 0, 0);
 
-		default:
-			return RLM_MODULE_FAIL;
-		}
+		return ippool_release_rcode(request,
+					    redis_ippool_release(inst, request, key_prefix, key_prefix_len,
+								 &ip, device_id, device_id_len),
+					    ip_str);
 	}
 
 	case POOL_ACTION_BULK_RELEASE:
@@ -1223,8 +1861,8 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request,
 	}
 }
 
-static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_accounting(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_accounting(void *instance, void *thread, REQUEST *request)
 {
 	rlm_redis_ippool_t const	*inst = instance;
 	VALUE_PAIR			*vp;
@@ -1233,7 +1871,7 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 	 *	Pool-Action override
 	 */
 	vp = fr_pair_find_by_num(request->control, 0, FR_POOL_ACTION, TAG_ANY);
-	if (vp) return mod_action(inst, request, vp->vp_uint32);
+	if (vp) return mod_action(inst, thread, request, vp->vp_uint32);
 
 	/*
 	 *	Otherwise, guess the action by Acct-Status-Type
@@ -1247,22 +1885,22 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 	switch (vp->vp_uint32) {
 	case FR_STATUS_START:
 	case FR_STATUS_ALIVE:
-		return mod_action(inst, request, POOL_ACTION_UPDATE);
+		return mod_action(inst, thread, request, POOL_ACTION_UPDATE);
 
 	case FR_STATUS_STOP:
-		return mod_action(inst, request, POOL_ACTION_RELEASE);
+		return mod_action(inst, thread, request, POOL_ACTION_RELEASE);
 
 	case FR_STATUS_ACCOUNTING_OFF:
 	case FR_STATUS_ACCOUNTING_ON:
-		return mod_action(inst, request, POOL_ACTION_BULK_RELEASE);
+		return mod_action(inst, thread, request, POOL_ACTION_BULK_RELEASE);
 
 	default:
 		return RLM_MODULE_NOOP;
 	}
 }
 
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request)
 {
 	rlm_redis_ippool_t const	*inst = instance;
 	VALUE_PAIR			*vp;
@@ -1272,11 +1910,11 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 	 *	when called in Post-Auth.
 	 */
 	vp = fr_pair_find_by_num(request->control, 0, FR_POOL_ACTION, TAG_ANY);
-	return mod_action(inst, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
+	return mod_action(inst, thread, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
 }
 
-static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_post_auth(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_post_auth(void *instance, void *thread, REQUEST *request)
 {
 	rlm_redis_ippool_t const	*inst = instance;
 	VALUE_PAIR			*vp;
@@ -1286,7 +1924,27 @@ static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *r
 	 *	when called in Post-Auth.
 	 */
 	vp = fr_pair_find_by_num(request->control, 0, FR_POOL_ACTION, TAG_ANY);
-	return mod_action(inst, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
+	return mod_action(inst, thread, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
+}
+
+static int _ippool_stats_free(ippool_stats_t *stats)
+{
+	pthread_mutex_destroy(&stats->mutex);
+
+	return 0;
+}
+
+static int mod_bootstrap(void *instance, CONF_SECTION *conf)
+{
+	rlm_redis_ippool_t	*inst = instance;
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	inst->latency_xlat = talloc_asprintf(inst, "%s_latency", inst->name);
+	xlat_register(inst, inst->latency_xlat, ippool_latency_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+
+	return 0;
 }
 
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
@@ -1328,8 +1986,51 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		fr_sha1_update(&sha1_ctx, (uint8_t const *)lua_release_cmd, sizeof(lua_release_cmd) - 1);
 		fr_sha1_final(digest, &sha1_ctx);
 		fr_bin2hex(lua_release_digest, digest, sizeof(digest));
+
+		done_hash = true;
 	}
 
+	/*
+	 *	Load the scripts onto every node we connect to,
+	 *	so the first EVALSHA doesn't need to upload them.
+	 */
+	fr_redis_cluster_script_preload(inst->cluster, lua_alloc_cmd);
+	fr_redis_cluster_script_preload(inst->cluster, lua_update_cmd);
+	fr_redis_cluster_script_preload(inst->cluster, lua_release_cmd);
+
+	if (inst->pipeline && inst->wait_num) {
+		cf_log_err(conf, "'wait_num' can't be used with 'pipeline = yes'");
+		return -1;
+	}
+
+	if (inst->lease_max_entries) {
+		if (inst->wait_num) {
+			cf_log_err(conf, "'wait_num' can't be used with a lease table");
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("lease_table.writeback_batch", inst->lease_writeback_batch, >=, 1);
+
+		inst->leases = ippool_lease_table_alloc(inst, inst->lease_max_entries);
+		if (!inst->leases) {
+			cf_log_err(conf, "Failed creating lease table: %s", fr_strerror());
+			return -1;
+		}
+	}
+
+	MEM(inst->stats = talloc_zero(inst, ippool_stats_t));
+	inst->stats->pools = rbtree_create(inst->stats, ippool_latency_cmp, NULL, 0);
+	if (!inst->stats->pools) {
+		cf_log_err(conf, "Failed creating latency tree");
+		return -1;
+	}
+
+	if (pthread_mutex_init(&inst->stats->mutex, NULL) < 0) {
+		cf_log_err(conf, "Failed initializing mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+	talloc_set_destructor(inst->stats, _ippool_stats_free);
+
 	/*
 	 *	If we don't have a separate time specifically for offers
 	 *	just use the lease time.
@@ -1339,6 +2040,46 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_redis_ippool_t	*inst = instance;
+	rlm_redis_ippool_thread_t *t = thread;
+
+	if (!inst->pipeline && !inst->leases) return 0;
+
+	t->cluster = fr_redis_cluster_thread_alloc(NULL, inst->cluster, el);
+	if (!t->cluster) return -1;
+
+	if (!inst->leases) return 0;
+
+	/*
+	 *	Write-backs don't belong to any request,
+	 *	so they're issued as this one.
+	 */
+	t->el = el;
+	t->request = request_alloc(NULL);
+	if (!t->request) return -1;
+	t->writeback_tail = &t->writeback_head;
+
+	return 0;
+}
+
+static int mod_thread_detach(void *thread)
+{
+	rlm_redis_ippool_thread_t *t = thread;
+
+	if (t->writeback_ev) (void) fr_event_timer_delete(t->el, &t->writeback_ev);
+
+	/*
+	 *	Frees the commands in flight first, so no
+	 *	write-back sees a freed request.
+	 */
+	talloc_free(t->cluster);
+	talloc_free(t->request);
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	fr_redis_version_print();
@@ -1352,9 +2093,13 @@ rad_module_t rlm_redis_ippool = {
 	.name		= "redis",
 	.type		= RLM_TYPE_THREAD_SAFE,
 	.inst_size	= sizeof(rlm_redis_ippool_t),
+	.thread_inst_size	= sizeof(rlm_redis_ippool_thread_t),
 	.config		= module_config,
 	.load		= mod_load,
+	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_AUTHORIZE]		= mod_authorize,
@@ -9,7 +9,7 @@ ifneq "${TARGETNAME}" ""
   TARGET	:= $(TARGETNAME).a
 endif
 
-SOURCES	:= $(TARGETNAME).c
+SOURCES	:= $(TARGETNAME).c lease.c
 
 SRC_CFLAGS	+= -I$(top_builddir)/src/modules/rlm_redis
 TGT_PREREQS	:= libfreeradius-redis.a
@@ -29,11 +29,16 @@ RCSID("$Id$")
 #include <freeradius-devel/cf_parse.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include <pthread.h>
+
 #include "redis.h"
 #include "cluster.h"
+#include "crc16.h"
 #include "redis_ippool.h"
 
 #define MAX_PIPELINED 100000
+#define MAX_QUEUED 1024			//!< Maximum import operations waiting for each worker.
+#define MAX_WORKERS 64			//!< Maximum number of import workers.
 
 /** Pool management actions
  *
@@ -126,6 +131,7 @@ do { \
 #define EOL "\n"
 
 static char const *name;
+static bool progress;			//!< Report throughput after each pipeline round trip.
 /** Lua script for releasing a lease
  *
  * - KEYS[1] The pool name.
@@ -214,7 +220,12 @@ static void NEVER_RETURNS usage(int ret) {
 	INFO("                         in this range.");
 	INFO("  -l                     List available pools.");
 //	INFO("  -L                     List available ranges in pool [NYI]");
-//	INFO("  -i file                Import entries from ISC lease file [NYI]");
+	INFO("  -i file                Perform the operations listed in file (- for stdin).");
+	INFO("                         Each line is <action> <pool> <range> [<prefix_len>|- [<range id>]]");
+	INFO("                         where action is one of add, remove, release or modify.");
+	INFO("  -j workers             Number of workers used to perform imported operations.");
+	INFO("                         Operations on pools in the same key slot are performed");
+	INFO("                         in order, by the same worker.");
 	INFO(" ");	/* -Werror=format-zero-length */
 //	INFO("Pool status:");
 //	INFO("  -I                     Output active entries in ISC lease file format [NYI]");
@@ -223,6 +234,7 @@ static void NEVER_RETURNS usage(int ret) {
 	INFO("Configuration:");
 	INFO("  -h                     Print this help message and exit");
 	INFO("  -x                     Increase the verbosity level");
+	INFO("  -P                     Report progress and throughput");
 //	INFO("  -o attr=value          Set option, these are specific to the backends [NYI]");
 	INFO("  -f file                Load connection options from a FreeRADIUS (radisud) format config file");
 	INFO(" ");
@@ -459,13 +471,18 @@ static int driver_do_lease(void *out, void *instance, ippool_tool_operation_t co
 
 	fr_ipaddr_t			ipaddr = op->start, acked;
 	int				s_ret = REDIS_RCODE_SUCCESS;
-	REQUEST				*request = request_alloc(inst);
+	REQUEST				*request = request_alloc(NULL);	/* May be called concurrently */
 	redisReply			**replies = NULL;
 
 	unsigned int			pipelined = 0;
+	uint64_t			done = 0;
+	struct timeval			start;
+
+	gettimeofday(&start, NULL);
 
 	while (more) {
 		size_t	reply_cnt = 0;
+		int	batch = 0;
 
 		/* Record our progress */
 		acked = ipaddr;
@@ -489,8 +506,9 @@ static int driver_do_lease(void *out, void *instance, ippool_tool_operation_t co
 				if (enqueued < 0) break;
 				pipelined += enqueued;
 			}
+			batch = i;
 
-			if (!replies) replies = talloc_zero_array(inst, redisReply *, pipelined);
+			if (!replies) replies = talloc_zero_array(request, redisReply *, pipelined);
 			if (!replies) return 0;
 
 			reply_cnt = fr_redis_pipeline_result(&pipelined, &status, replies,
@@ -518,6 +536,19 @@ static int driver_do_lease(void *out, void *instance, ippool_tool_operation_t co
 		}
 		fr_redis_pipeline_free(replies, reply_cnt);
 		TALLOC_FREE(replies);
+
+		done += batch;
+		if (progress) {
+			struct timeval	now, elapsed;
+			double		secs;
+
+			gettimeofday(&now, NULL);
+			fr_timeval_subtract(&elapsed, &now, &start);
+			secs = elapsed.tv_sec + (elapsed.tv_usec / 1000000.0);
+
+			INFO("%s: %" PRIu64 " address(es)/prefix(es) in %.2fs (%.0f/s)",
+			     op->name, done, secs, secs > 0 ? done / secs : 0);
+		}
 	}
 	talloc_free(request);
 
@@ -1340,6 +1371,281 @@ static int parse_ip_range(fr_ipaddr_t *start_out, fr_ipaddr_t *end_out, char con
 	return 0;
 }
 
+/** An import worker
+ *
+ * Operations are assigned to workers by the key slot of their pool, so
+ * operations on the same pool are always performed in order, and pools
+ * held by different masters can be populated in parallel.
+ */
+typedef struct ippool_tool_worker {
+	pthread_t		thread;
+	void			*driver;	//!< Shared driver instance.
+
+	pthread_mutex_t		mutex;		//!< Protects the queue and done flag.
+	pthread_cond_t		cond;		//!< Signalled when the queue changes.
+	fr_fifo_t		*queue;		//!< Operations waiting to be performed.
+	bool			done;		//!< No more operations will be queued.
+
+	bool			failed;		//!< An operation failed, discard the rest.
+	uint64_t		count[IPPOOL_TOOL_MODIFY + 1];	//!< Addresses affected, by action.
+} ippool_tool_worker_t;
+
+static void *ippool_tool_worker(void *arg)
+{
+	ippool_tool_worker_t	*worker = arg;
+	ippool_tool_operation_t	*op;
+
+	for (;;) {
+		int ret = 0;
+
+		pthread_mutex_lock(&worker->mutex);
+		while (!(op = fr_fifo_pop(worker->queue)) && !worker->done) {
+			pthread_cond_wait(&worker->cond, &worker->mutex);
+		}
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->mutex);
+
+		if (!op) break;
+
+		if (!worker->failed) switch (op->action) {
+		case IPPOOL_TOOL_ADD:
+			ret = driver_add_lease(&worker->count[op->action], worker->driver, op);
+			break;
+
+		case IPPOOL_TOOL_REMOVE:
+			ret = driver_remove_lease(&worker->count[op->action], worker->driver, op);
+			break;
+
+		case IPPOOL_TOOL_RELEASE:
+			ret = driver_release_lease(&worker->count[op->action], worker->driver, op);
+			break;
+
+		case IPPOOL_TOOL_MODIFY:
+			ret = driver_modify_lease(&worker->count[op->action], worker->driver, op);
+			break;
+
+		default:
+			rad_assert(0);
+			break;
+		}
+		if (ret < 0) {
+			ERROR("Failed performing operation on \"%s\"", op->name);
+			worker->failed = true;
+		}
+		talloc_free(op);
+	}
+
+	return NULL;
+}
+
+/** Parse a single line of an import file
+ *
+ * @param[out] out	Where to write the operation.
+ * @param[in] line	to parse.  Will be modified.
+ * @param[in] lineno	Line number, for error messages.
+ * @return
+ *	- 1 if an operation was produced.
+ *	- 0 if the line was blank, or a comment.
+ *	- -1 on error.
+ */
+static int import_line_parse(ippool_tool_operation_t **out, char *line, unsigned int lineno)
+{
+	static FR_NAME_NUMBER const actions[] = {
+		{ "add",	IPPOOL_TOOL_ADD },
+		{ "remove",	IPPOOL_TOOL_REMOVE },
+		{ "release",	IPPOOL_TOOL_RELEASE },
+		{ "modify",	IPPOOL_TOOL_MODIFY },
+		{ NULL,		-1 }
+	};
+
+	ippool_tool_operation_t	*op;
+	char			*argv[5], *save = NULL, *tok;
+	int			argc = 0;
+	int			action;
+
+	*out = NULL;
+
+	for (tok = strtok_r(line, " \t\r\n", &save);
+	     tok && (*tok != '#');
+	     tok = strtok_r(NULL, " \t\r\n", &save)) {
+		if (argc == (sizeof(argv) / sizeof(*argv))) {
+			ERROR("Line %u: Too many fields", lineno);
+			return -1;
+		}
+		argv[argc++] = tok;
+	}
+	if (argc == 0) return 0;
+
+	if (argc < 3) {
+		ERROR("Line %u: Expected <action> <pool> <range> [<prefix_len>|- [<range id>]]", lineno);
+		return -1;
+	}
+
+	action = fr_str2int(actions, argv[0], -1);
+	if (action < 0) {
+		ERROR("Line %u: Invalid action \"%s\"", lineno, argv[0]);
+		return -1;
+	}
+
+	MEM(op = talloc_zero(NULL, ippool_tool_operation_t));
+	op->action = action;
+	op->pool = talloc_memdup(op, argv[1], strlen(argv[1]));
+	op->pool_len = strlen(argv[1]);
+	op->name = talloc_strdup(op, argv[2]);
+
+	if ((argc > 3) && (strcmp(argv[3], "-") != 0)) {
+		unsigned long	tmp;
+		char		*q;
+
+		tmp = strtoul(argv[3], &q, 10);
+		if ((*q != '\0') || (tmp > 128)) {
+			ERROR("Line %u: Prefix must be an integer value between 1-128", lineno);
+		error:
+			talloc_free(op);
+			return -1;
+		}
+		op->prefix = (uint8_t)tmp;
+	}
+
+	if (argc > 4) {
+		op->range = talloc_memdup(op, argv[4], strlen(argv[4]));
+		op->range_len = strlen(argv[4]);
+	}
+
+	if (parse_ip_range(&op->start, &op->end, op->name, op->prefix) < 0) {
+		ERROR("Line %u: Invalid range \"%s\"", lineno, op->name);
+		goto error;
+	}
+	if (!op->prefix) op->prefix = IPADDR_LEN(op->start.af);
+
+	*out = op;
+
+	return 1;
+}
+
+/** Perform the operations listed in an import file
+ *
+ * The file is read one line at a time, so arbitrarily large files may be
+ * imported without holding them in memory.
+ *
+ * @param[in] driver	instance.
+ * @param[in] file	to read operations from, or "-" for stdin.
+ * @param[in] num	Number of workers.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int driver_import(void *driver, char const *file, unsigned int num)
+{
+	FILE			*fp;
+	char			buff[8192];
+	unsigned int		lineno = 0, i;
+	int			ret = 0;
+	ippool_tool_worker_t	*workers;
+	uint64_t		count[IPPOOL_TOOL_MODIFY + 1] = { 0 }, total = 0;
+	struct timeval		start, now, elapsed;
+	double			secs;
+
+	if (strcmp(file, "-") == 0) {
+		fp = stdin;
+	} else {
+		fp = fopen(file, "r");
+		if (!fp) {
+			ERROR("Failed opening \"%s\": %s", file, fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	gettimeofday(&start, NULL);
+
+	MEM(workers = talloc_zero_array(NULL, ippool_tool_worker_t, num));
+	for (i = 0; i < num; i++) {
+		workers[i].driver = driver;
+		MEM(workers[i].queue = fr_fifo_create(workers, MAX_QUEUED, NULL));
+		pthread_mutex_init(&workers[i].mutex, NULL);
+		pthread_cond_init(&workers[i].cond, NULL);
+
+		ret = pthread_create(&workers[i].thread, NULL, ippool_tool_worker, &workers[i]);
+		if (ret != 0) {
+			ERROR("Failed creating worker: %s", fr_syserror(ret));
+			exit(1);
+		}
+	}
+
+	while (fgets(buff, sizeof(buff), fp)) {
+		ippool_tool_operation_t	*op;
+		ippool_tool_worker_t	*worker;
+
+		lineno++;
+		switch (import_line_parse(&op, buff, lineno)) {
+		case 1:
+			break;
+
+		case 0:
+			continue;
+
+		default:
+			ret = -1;
+			goto finish;
+		}
+
+		/*
+		 *	Pool keys are all in the {<pool>} hash slot,
+		 *	so the slot determines which master the
+		 *	operation is performed on.
+		 */
+		worker = &workers[(fr_crc16_xmodem(op->pool, op->pool_len) & (16384 - 1)) % num];
+
+		pthread_mutex_lock(&worker->mutex);
+		while (fr_fifo_push(worker->queue, op) < 0) pthread_cond_wait(&worker->cond, &worker->mutex);
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->mutex);
+	}
+	if (ferror(fp)) {
+		ERROR("Failed reading \"%s\": %s", file, fr_syserror(errno));
+		ret = -1;
+	}
+
+finish:
+	for (i = 0; i < num; i++) {
+		unsigned int j;
+
+		/*
+		 *	Don't perform the rest of the file
+		 *	if part of it was invalid.
+		 */
+		pthread_mutex_lock(&workers[i].mutex);
+		if (ret < 0) workers[i].failed = true;
+		workers[i].done = true;
+		pthread_cond_signal(&workers[i].cond);
+		pthread_mutex_unlock(&workers[i].mutex);
+
+		pthread_join(workers[i].thread, NULL);
+		pthread_cond_destroy(&workers[i].cond);
+		pthread_mutex_destroy(&workers[i].mutex);
+
+		if (workers[i].failed) ret = -1;
+		for (j = 0; j < (sizeof(count) / sizeof(*count)); j++) count[j] += workers[i].count[j];
+	}
+	talloc_free(workers);
+	if (fp != stdin) fclose(fp);
+
+	gettimeofday(&now, NULL);
+	fr_timeval_subtract(&elapsed, &now, &start);
+	secs = elapsed.tv_sec + (elapsed.tv_usec / 1000000.0);
+
+	for (i = 0; i < (sizeof(count) / sizeof(*count)); i++) total += count[i];
+
+	INFO("Added %" PRIu64 " address(es)/prefix(es)", count[IPPOOL_TOOL_ADD]);
+	INFO("Removed %" PRIu64 " address(es)/prefix(es)", count[IPPOOL_TOOL_REMOVE]);
+	INFO("Released %" PRIu64 " address(es)/prefix(es)", count[IPPOOL_TOOL_RELEASE]);
+	INFO("Modified %" PRIu64 " address(es)/prefix(es)", count[IPPOOL_TOOL_MODIFY]);
+	INFO("Imported %u line(s) in %.2fs (%.0f address(es)/prefix(es)/s)",
+	     lineno, secs, secs > 0 ? total / secs : 0);
+
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	static ippool_tool_operation_t	ops[128];
@@ -1352,6 +1658,7 @@ int main(int argc, char *argv[])
 	bool				do_export = false, print_stats = false, list_pools = false;
 	bool				need_pool = false;
 	char				*do_import = NULL;
+	unsigned int			num_workers = 1;
 
 	CONF_SECTION			*pool_cs;
 	CONF_PAIR			*cp;
@@ -1379,7 +1686,7 @@ do { \
 	need_pool = true; \
 } while (0);
 
-	while ((opt = getopt(argc, argv, "a:d:r:s:Sm:p:ilLhxo:f:")) != EOF)
+	while ((opt = getopt(argc, argv, "a:d:r:s:Sm:p:i:j:lLhxPo:f:")) != EOF)
 	switch (opt) {
 	case 'a':
 		ADD_ACTION(IPPOOL_TOOL_ADD);
@@ -1425,6 +1732,24 @@ do { \
 		do_import = optarg;
 		break;
 
+	case 'j':
+	{
+		unsigned long tmp;
+		char *q;
+
+		tmp = strtoul(optarg, &q, 10);
+		if ((q != (optarg + strlen(optarg))) || (tmp == 0) || (tmp > MAX_WORKERS)) {
+			ERROR("Workers must be an integer value between 1-" STRINGIFY(MAX_WORKERS));
+			usage(64);
+		}
+		num_workers = (unsigned int)tmp;
+	}
+		break;
+
+	case 'P':
+		progress = true;
+		break;
+
 	case 'I':
 		do_export = true;
 		break;
@@ -1540,9 +1865,7 @@ do { \
 		exit(1);
 	}
 
-	if (do_import) {
-		ERROR("NOT YET IMPLEMENTED");
-	}
+	if (do_import && (driver_import(conf->driver, do_import, num_workers) < 0)) exit(1);
 
 	if (do_export) {
 		ERROR("NOT YET IMPLEMENTED");
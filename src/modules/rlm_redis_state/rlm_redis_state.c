@@ -0,0 +1,388 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_redis_state.c
+ * @brief Share &session-state between servers using Redis.
+ *
+ * Each time a state entry is created, a copy of its &session-state is
+ * written to Redis.  The write is sent without waiting for the reply, so
+ * it adds nothing to the time taken to respond.
+ *
+ * When the next round of the session arrives at the same server, the
+ * local entry is used, and Redis isn't asked.  When it arrives at another
+ * server, the lookup misses, and the module fetches the copy.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/modpriv.h>
+#include <freeradius-devel/state.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "../rlm_redis/redis.h"
+#include "../rlm_redis/cluster.h"
+
+/*
+ *	Longest key prefix we allow.
+ */
+#define REDIS_STATE_PREFIX_MAX	(128)
+
+typedef struct rlm_redis_state {
+	fr_redis_conf_t		*conf;		//!< Connection parameters for the Redis server.
+						//!< Must be first field in this struct.
+
+	char const		*name;		//!< Instance name.
+	fr_redis_cluster_t	*cluster;	//!< Pool O pools
+
+	char const		*prefix;	//!< Prepended to the State value to make the key.
+	size_t			prefix_len;	//!< Length of the prefix.
+
+	module_instance_t	*mod_inst;	//!< Our module instance, so the state callbacks
+						//!< can find the thread instance.
+	fr_state_backend_t	backend;	//!< Registered with the state code.
+} rlm_redis_state_t;
+
+static CONF_PARSER module_config[] = {
+	REDIS_COMMON_CONFIG,
+
+	{ FR_CONF_OFFSET("prefix", FR_TYPE_STRING, rlm_redis_state_t, prefix), .dflt = "session-state:" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+typedef struct rlm_redis_state_thread {
+	fr_redis_cluster_thread_t	*cluster;	//!< Async cluster state for this thread.
+} rlm_redis_state_thread_t;
+
+/** A write which nothing waits for
+ *
+ * Parented by the request.  If the request is freed first, the command is
+ * cancelled, and its reply ignored when it arrives.
+ */
+typedef struct {
+	fr_redis_cluster_async_t *cmd;		//!< Command in flight, NULL once the reply is received.
+} redis_state_write_t;
+
+/** Tracks a fetch for a single request
+ */
+typedef struct {
+	fr_redis_cluster_async_t *cmd;		//!< Command in flight, NULL once the reply is received.
+	fr_redis_rcode_t	status;		//!< Of the command.
+	uint8_t			*data;		//!< The copy, NULL if there wasn't one.
+} redis_state_fetch_t;
+
+/** Write the key for a state entry
+ *
+ * @param[out] out	where to write the key.  Must be REDIS_STATE_PREFIX_MAX + FR_STATE_KEY_LEN bytes.
+ * @param[in] inst	of rlm_redis_state.
+ * @param[in] key	of the state entry.
+ * @return the length of the key.
+ */
+static size_t redis_state_key(uint8_t *out, rlm_redis_state_t const *inst, uint8_t const *key)
+{
+	memcpy(out, inst->prefix, inst->prefix_len);
+	memcpy(out + inst->prefix_len, key, FR_STATE_KEY_LEN);
+
+	return inst->prefix_len + FR_STATE_KEY_LEN;
+}
+
+static int _redis_state_write_free(redis_state_write_t *op)
+{
+	if (op->cmd) fr_redis_cluster_async_cancel(op->cmd);
+
+	return 0;
+}
+
+static void _redis_state_write_reply(REQUEST *request, fr_redis_rcode_t status, UNUSED redisReply *reply, void *uctx)
+{
+	redis_state_write_t *op = uctx;
+
+	op->cmd = NULL;
+	if (status != REDIS_RCODE_SUCCESS) RWARN("Failed updating copy of &session-state");
+
+	talloc_free(op);
+}
+
+/** Send a command, without waiting for its reply
+ *
+ */
+static void redis_state_write(rlm_redis_state_t const *inst, REQUEST *request,
+			      uint8_t const *key, size_t key_len,
+			      int argc, char const **argv, size_t const *argv_len)
+{
+	module_thread_instance_t	*ti = module_thread_instance_find(inst->mod_inst);
+	rlm_redis_state_thread_t	*t = ti->data;
+	redis_state_write_t		*op;
+
+	MEM(op = talloc_zero(request, redis_state_write_t));
+
+	op->cmd = fr_redis_cluster_async_command(t->cluster, request, key, key_len, false,
+						 argc, argv, argv_len, _redis_state_write_reply, op);
+	if (!op->cmd) {
+		RWARN("Failed updating copy of &session-state: %s", fr_strerror());
+		talloc_free(op);
+		return;
+	}
+
+	talloc_set_destructor(op, _redis_state_write_free);
+}
+
+/** Write a copy of a state entry
+ *
+ */
+static void _redis_state_store(REQUEST *request, uint8_t const *key, uint8_t const *data, size_t data_len,
+			       uint32_t ttl, void *uctx)
+{
+	rlm_redis_state_t const	*inst = uctx;
+	uint8_t			buff[REDIS_STATE_PREFIX_MAX + FR_STATE_KEY_LEN];
+	char			ttl_buff[sizeof("4294967295")];
+	char const		*argv[5];
+	size_t			argv_len[5];
+	int			argc = 3;
+
+	argv[0] = "SET";
+	argv_len[0] = 3;
+	argv[1] = (char const *)buff;
+	argv_len[1] = redis_state_key(buff, inst, key);
+	argv[2] = (char const *)data;
+	argv_len[2] = data_len;
+
+	if (ttl) {
+		argv[3] = "EX";
+		argv_len[3] = 2;
+		argv[4] = ttl_buff;
+		argv_len[4] = snprintf(ttl_buff, sizeof(ttl_buff), "%u", ttl);
+		argc = 5;
+	}
+
+	RDEBUG2("Copying &session-state to Redis");
+	redis_state_write(inst, request, buff, argv_len[1], argc, argv, argv_len);
+}
+
+/** Remove the copy of a state entry
+ *
+ */
+static void _redis_state_discard(REQUEST *request, uint8_t const *key, void *uctx)
+{
+	rlm_redis_state_t const	*inst = uctx;
+	uint8_t			buff[REDIS_STATE_PREFIX_MAX + FR_STATE_KEY_LEN];
+	char const		*argv[2];
+	size_t			argv_len[2];
+
+	argv[0] = "DEL";
+	argv_len[0] = 3;
+	argv[1] = (char const *)buff;
+	argv_len[1] = redis_state_key(buff, inst, key);
+
+	redis_state_write(inst, request, buff, argv_len[1], 2, argv, argv_len);
+}
+
+static void _redis_state_fetch_reply(REQUEST *request, fr_redis_rcode_t status, redisReply *reply, void *uctx)
+{
+	redis_state_fetch_t *fetch = uctx;
+
+	fetch->cmd = NULL;
+	fetch->status = status;
+
+	if ((status == REDIS_RCODE_SUCCESS) && rad_cond_assert(reply) && (reply->type == REDIS_REPLY_STRING)) {
+		MEM(fetch->data = talloc_memdup(fetch, reply->str, reply->len));
+	}
+
+	unlang_resumable(request);
+}
+
+static rlm_rcode_t mod_authorize_resume(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx)
+{
+	redis_state_fetch_t	*fetch = ctx;
+	rlm_rcode_t		rcode;
+
+	if (fetch->status != REDIS_RCODE_SUCCESS) {
+		REDEBUG("Failed fetching copy of &session-state");
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	if (!fetch->data) {
+		RDEBUG2("No copy of &session-state found");
+		rcode = RLM_MODULE_NOTFOUND;
+		goto finish;
+	}
+
+	if (fr_state_restore(global_state, request, fetch->data, talloc_array_length(fetch->data)) < 0) {
+		RPEDEBUG("Failed restoring &session-state");
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+	rcode = RLM_MODULE_UPDATED;
+
+finish:
+	talloc_free(fetch);
+
+	return rcode;
+}
+
+static void mod_authorize_signal(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+				 void *ctx, fr_state_action_t action)
+{
+	redis_state_fetch_t	*fetch = ctx;
+
+	if (action != FR_ACTION_DONE) return;
+
+	if (fetch->cmd) {
+		fr_redis_cluster_async_cancel(fetch->cmd);
+		fetch->cmd = NULL;
+	}
+}
+
+/*
+ *	Fetch the copy of &session-state, if the request's State
+ *	wasn't found locally.
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, void *thread, REQUEST *request)
+{
+	rlm_redis_state_t const		*inst = instance;
+	rlm_redis_state_thread_t	*t = thread;
+	redis_state_fetch_t		*fetch;
+	uint8_t				key[FR_STATE_KEY_LEN];
+	uint8_t				buff[REDIS_STATE_PREFIX_MAX + FR_STATE_KEY_LEN];
+	char const			*argv[2];
+	size_t				argv_len[2];
+
+	if (!fr_state_missed(global_state, key, request)) return RLM_MODULE_NOOP;
+
+	MEM(fetch = talloc_zero(request, redis_state_fetch_t));
+
+	argv[0] = "GET";
+	argv_len[0] = 3;
+	argv[1] = (char const *)buff;
+	argv_len[1] = redis_state_key(buff, inst, key);
+
+	/*
+	 *	Slaves may not have the copy yet, so we ask
+	 *	the master.
+	 */
+	RDEBUG2("No local &session-state, fetching copy from Redis");
+	fetch->cmd = fr_redis_cluster_async_command(t->cluster, request, buff, argv_len[1], false,
+						    2, argv, argv_len, _redis_state_fetch_reply, fetch);
+	if (!fetch->cmd) {
+		RPERROR("Failed fetching copy of &session-state");
+		talloc_free(fetch);
+		return RLM_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, mod_authorize_resume, mod_authorize_signal, fetch);
+}
+
+static int mod_bootstrap(void *instance, CONF_SECTION *conf)
+{
+	rlm_redis_state_t *inst = instance;
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	return 0;
+}
+
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_redis_state_t *inst = instance;
+
+	inst->prefix_len = talloc_array_length(inst->prefix) - 1;
+	if (inst->prefix_len > REDIS_STATE_PREFIX_MAX) {
+		cf_log_err(conf, "'prefix' must be no longer than %u characters", REDIS_STATE_PREFIX_MAX);
+		return -1;
+	}
+
+	inst->mod_inst = module_find(cf_section_find(main_config.config, "modules", NULL), inst->name);
+	if (!inst->mod_inst) {
+		cf_log_err(conf, "Failed finding module instance \"%s\"", inst->name);
+		return -1;
+	}
+
+	inst->cluster = fr_redis_cluster_alloc(inst, conf, inst->conf, true, NULL, NULL, NULL);
+	if (!inst->cluster) return -1;
+
+	inst->backend.store = _redis_state_store;
+	inst->backend.discard = _redis_state_discard;
+	inst->backend.uctx = inst;
+
+	if (fr_state_backend_register(&inst->backend) < 0) {
+		cf_log_err(conf, "%s", fr_strerror());
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_redis_state_t *inst = instance;
+
+	if (inst->backend.uctx) fr_state_backend_register(NULL);
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_redis_state_t		*inst = instance;
+	rlm_redis_state_thread_t	*t = thread;
+
+	t->cluster = fr_redis_cluster_thread_alloc(NULL, inst->cluster, el);
+	if (!t->cluster) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(void *thread)
+{
+	rlm_redis_state_thread_t	*t = thread;
+
+	talloc_free(t->cluster);
+
+	return 0;
+}
+
+static int mod_load(void)
+{
+	fr_redis_version_print();
+
+	return 0;
+}
+
+extern rad_module_t rlm_redis_state;
+rad_module_t rlm_redis_state = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "redis_state",
+	.type		= RLM_TYPE_THREAD_SAFE,
+	.inst_size	= sizeof(rlm_redis_state_t),
+	.thread_inst_size	= sizeof(rlm_redis_state_thread_t),
+	.config		= module_config,
+	.load		= mod_load,
+	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
+	.methods = {
+		[MOD_AUTHORIZE]		= mod_authorize
+	},
+};
@@ -76,20 +76,81 @@ static CONF_PARSER module_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+typedef struct rlm_rediswho_thread {
+	fr_redis_cluster_thread_t	*cluster;	//!< Async cluster state for this thread.
+} rlm_rediswho_thread_t;
+
+/** Commands issued for each accounting request, in order
+ */
+typedef enum {
+	REDISWHO_INSERT = 0,
+	REDISWHO_TRIM,
+	REDISWHO_EXPIRE,
+	REDISWHO_MAX
+} rediswho_stage_t;
+
+typedef struct rediswho_state rediswho_state_t;
+
+/** A single command issued for an accounting request
+ */
+typedef struct {
+	rediswho_state_t	*state;		//!< Request the command belongs to.
+	fr_redis_cluster_async_t *cmd;		//!< Command in flight, NULL once the reply is received.
+} rediswho_cmd_t;
+
+/** Tracks the commands for a single accounting request
+ *
+ * All the commands are issued together.  They share a key, so they go to
+ * the same node, and are written to it in order, in the same pass of the
+ * event loop.  The request resumes once every reply has arrived.
+ */
+struct rediswho_state {
+	rediswho_cmd_t		cmds[REDISWHO_MAX];	//!< Commands, indexed by stage.
+	int			outstanding;		//!< Replies we're still waiting for.
+	bool			failed;			//!< One or more of the commands failed.
+};
+
 /*
- *	Query the database executing a command with no result rows
+ *	Process the reply to a command with no result rows
  */
-static int rediswho_command(rlm_rediswho_t const *inst, REQUEST *request, char const *fmt)
+static void _rediswho_reply(REQUEST *request, fr_redis_rcode_t status, redisReply *reply, void *uctx)
 {
-	fr_redis_conn_t		*conn;
+	rediswho_cmd_t		*cmd = uctx;
+	rediswho_state_t	*state = cmd->state;
+
+	cmd->cmd = NULL;
+
+	if ((status != REDIS_RCODE_SUCCESS) || !rad_cond_assert(reply)) {
+		RERROR("Failed inserting accounting data");
+		state->failed = true;
+		goto finish;
+	}
+
+	switch (reply->type) {
+	case REDIS_REPLY_INTEGER:
+		RDEBUG2("Query response %lld", reply->integer);
+		break;
 
-	int 			ret = -1;
+	case REDIS_REPLY_STRING:
+		REDEBUG2("Query response %s", reply->str);
+		break;
+
+	default:
+		break;
+	}
 
-	fr_redis_cluster_state_t	state;
-	fr_redis_rcode_t		status;
-	redisReply		*reply = NULL;
-	int			s_ret;
+finish:
+	if (--state->outstanding == 0) unlang_resumable(request);
+}
 
+/*
+ *	Send a command to the database, without waiting for the result
+ *
+ *	Returns 0 if the command was sent, 1 if there was no command to send,
+ *	and -1 on error.
+ */
+static int rediswho_command(rlm_rediswho_thread_t *t, REQUEST *request, char const *fmt, rediswho_cmd_t *cmd)
+{
 	uint8_t	const		*key = NULL;
 	size_t			key_len = 0;
 
@@ -97,7 +158,7 @@ static int rediswho_command(rlm_rediswho_t const *inst, REQUEST *request, char c
 	char const		*argv[MAX_REDIS_ARGS];
 	char			argv_buf[MAX_REDIS_COMMAND_LEN];
 
-	if (!fmt || !*fmt) return 0;
+	if (!fmt || !*fmt) return 1;
 
 	argc = rad_expand_xlat(request, fmt, MAX_REDIS_ARGS, argv, false, sizeof(argv_buf), argv_buf);
  	if (argc < 0) return -1;
@@ -114,65 +175,63 @@ static int rediswho_command(rlm_rediswho_t const *inst, REQUEST *request, char c
 	 	key_len = strlen((char const *)key);
 	}
 
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, key, key_len, false);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
-		reply = redisCommandArgv(conn->handle, argc, argv, NULL);
-		status = fr_redis_command_status(conn, reply);
-	}
-	if (s_ret != REDIS_RCODE_SUCCESS) {
-		RERROR("Failed inserting accounting data");
-	error:
-		fr_redis_reply_free(reply);
+	cmd->cmd = fr_redis_cluster_async_command(t->cluster, request, key, key_len, false,
+						  argc, argv, NULL, _rediswho_reply, cmd);
+	if (!cmd->cmd) {
+		RPERROR("Failed inserting accounting data");
 		return -1;
 	}
-	if (!rad_cond_assert(reply)) goto error;
+	cmd->state->outstanding++;
 
-	switch (reply->type) {
-	case REDIS_REPLY_INTEGER:
-		RDEBUG2("Query response %lld", reply->integer);
-		if (reply->integer > 0) ret = reply->integer;
-		break;
+	return 0;
+}
 
-	case REDIS_REPLY_STRING:
-		REDEBUG2("Query response %s", reply->str);
-		break;
+/*
+ *	Cancel any commands still waiting for a reply
+ */
+static void rediswho_cancel(rediswho_state_t *state)
+{
+	int i;
 
-	default:
-		break;
-	}
-	fr_redis_reply_free(reply);
+	for (i = 0; i < REDISWHO_MAX; i++) {
+		if (!state->cmds[i].cmd) continue;
 
-	return ret;
+		fr_redis_cluster_async_cancel(state->cmds[i].cmd);
+		state->cmds[i].cmd = NULL;
+	}
+	state->outstanding = 0;
 }
 
-static rlm_rcode_t mod_accounting_all(rlm_rediswho_t const *inst, REQUEST *request,
-				      char const *insert,
-				      char const *trim,
-				      char const *expire)
+static rlm_rcode_t mod_accounting_resume(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+					 void *ctx)
 {
-	int ret;
-
-	ret = rediswho_command(inst, request, insert);
-	if (ret < 0) return RLM_MODULE_FAIL;
+	rediswho_state_t	*state = ctx;
 
-	/* Only trim if necessary */
-	if ((inst->trim_count >= 0) && (ret > inst->trim_count)) {
-		if (rediswho_command(inst, request, trim) < 0) return RLM_MODULE_FAIL;
-	}
+	if (state->failed) return RLM_MODULE_FAIL;
 
-	if (rediswho_command(inst, request, expire) < 0) return RLM_MODULE_FAIL;
 	return RLM_MODULE_OK;
 }
 
-static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+static void mod_accounting_signal(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+				  void *ctx, fr_state_action_t action)
+{
+	rediswho_state_t	*state = ctx;
+
+	if (action != FR_ACTION_DONE) return;
+
+	rediswho_cancel(state);
+}
+
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, void *thread, REQUEST *request)
 {
 	rlm_rediswho_t const	*inst = instance;
-	rlm_rcode_t		rcode;
+	rlm_rediswho_thread_t	*t = thread;
 	VALUE_PAIR		*vp;
 	fr_dict_enum_t		*dv;
 	CONF_SECTION		*cs;
-	char const		*insert, *trim, *expire;
+	rediswho_state_t	*state;
+	char const		*fmt[REDISWHO_MAX];
+	int			i;
 
 	vp = fr_pair_find_by_num(request->packet->vps, 0, FR_ACCT_STATUS_TYPE, TAG_ANY);
 	if (!vp) {
@@ -192,13 +251,35 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 		return RLM_MODULE_NOOP;
 	}
 
-	insert = cf_pair_value(cf_pair_find(cs, "insert"));
-	trim = cf_pair_value(cf_pair_find(cs, "trim"));
-	expire = cf_pair_value(cf_pair_find(cs, "expire"));
+	fmt[REDISWHO_INSERT] = cf_pair_value(cf_pair_find(cs, "insert"));
+	fmt[REDISWHO_TRIM] = cf_pair_value(cf_pair_find(cs, "trim"));
+	fmt[REDISWHO_EXPIRE] = cf_pair_value(cf_pair_find(cs, "expire"));
 
-	rcode = mod_accounting_all(inst, request, insert, trim, expire);
+	/*
+	 *	Trimming used to wait for the insert, to see if
+	 *	the list had grown past trim_count.  Trimming a
+	 *	list which is short enough does nothing, so we
+	 *	trim unconditionally, rather than wait.
+	 */
+	if (inst->trim_count < 0) fmt[REDISWHO_TRIM] = NULL;
+
+	MEM(state = talloc_zero(request, rediswho_state_t));
+	for (i = 0; i < REDISWHO_MAX; i++) {
+		state->cmds[i].state = state;
 
-	return rcode;
+		if (rediswho_command(t, request, fmt[i], &state->cmds[i]) < 0) {
+			rediswho_cancel(state);
+			talloc_free(state);
+			return RLM_MODULE_FAIL;
+		}
+	}
+
+	if (state->outstanding == 0) {
+		talloc_free(state);
+		return RLM_MODULE_OK;
+	}
+
+	return unlang_module_yield(request, mod_accounting_resume, mod_accounting_signal, state);
 }
 
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
@@ -222,6 +303,26 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_rediswho_t		*inst = instance;
+	rlm_rediswho_thread_t	*t = thread;
+
+	t->cluster = fr_redis_cluster_thread_alloc(NULL, inst->cluster, el);
+	if (!t->cluster) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(void *thread)
+{
+	rlm_rediswho_thread_t	*t = thread;
+
+	talloc_free(t->cluster);
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	fr_redis_version_print();
@@ -235,10 +336,13 @@ rad_module_t rlm_rediswho = {
 	.name		= "rediswho",
 	.type		= RLM_TYPE_THREAD_SAFE,
 	.inst_size	= sizeof(rlm_rediswho_t),
+	.thread_inst_size	= sizeof(rlm_rediswho_thread_t),
 	.config		= module_config,
 	.load		= mod_load,
 	.instantiate	= mod_instantiate,
 	.bootstrap	= mod_bootstrap,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting
 	},
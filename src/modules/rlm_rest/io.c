@@ -397,9 +397,11 @@ int rest_io_request_enqueue(rlm_rest_thread_t *t, REQUEST *request, void *handle
  */
 int rest_io_init(rlm_rest_thread_t *thread)
 {
-	CURLMcode	ret;
-	CURLM		*mandle;
-	char const	*option = "unknown";
+	rlm_rest_t const	*inst = thread->inst;
+	CURLMcode		ret;
+	CURLSHcode		sret;
+	CURLM			*mandle;
+	char const		*option = "unknown";
 
 	mandle = thread->mandle = curl_multi_init();
 	if (!thread->mandle) {
@@ -413,6 +415,34 @@ int rest_io_init(rlm_rest_thread_t *thread)
 	SET_OPTION(CURLMOPT_SOCKETFUNCTION, _rest_io_event_modify);
 	SET_OPTION(CURLMOPT_SOCKETDATA, thread);
 
+#ifdef CURLPIPE_MULTIPLEX
+	SET_OPTION(CURLMOPT_PIPELINING, inst->multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+#endif
+	if (inst->max_host_connections) SET_OPTION(CURLMOPT_MAX_HOST_CONNECTIONS, (long)inst->max_host_connections);
+	if (inst->max_total_connections) SET_OPTION(CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)inst->max_total_connections);
+#if LIBCURL_VERSION_NUM >= 0x074300
+	if (inst->max_concurrent_streams) {
+		SET_OPTION(CURLMOPT_MAX_CONCURRENT_STREAMS, (long)inst->max_concurrent_streams);
+	}
+#endif
+
+	/*
+	 *	All of this thread's easy handles are serviced
+	 *	by the same event loop, so the share doesn't
+	 *	need locking.
+	 */
+	thread->share = curl_share_init();
+	if (!thread->share) {
+		ERROR("Curl share instantiation failed");
+		return -1;
+	}
+
+	if (((sret = curl_share_setopt(thread->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS)) != CURLSHE_OK) ||
+	    ((sret = curl_share_setopt(thread->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION)) != CURLSHE_OK)) {
+		ERROR("Failed configuring curl share: %s (%i)", curl_share_strerror(sret), sret);
+		return -1;
+	}
+
 	return 0;
 
 error:
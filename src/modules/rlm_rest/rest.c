@@ -184,6 +184,25 @@ const FR_NAME_NUMBER http_auth_table[] = {
 	{  NULL , -1 }
 };
 
+/** Conversion table for HTTP versions
+ *
+ * @see fr_str2int
+ */
+const FR_NAME_NUMBER http_version_table[] = {
+	{ "default",				CURL_HTTP_VERSION_NONE	},
+	{ "1.0",				CURL_HTTP_VERSION_1_0	},
+	{ "1.1",				CURL_HTTP_VERSION_1_1	},
+	{ "2",					CURL_HTTP_VERSION_2_0	},
+#if LIBCURL_VERSION_NUM >= 0x072f00
+	{ "2-tls",				CURL_HTTP_VERSION_2TLS	},
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073100
+	{ "2-prior-knowledge",			CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE },
+#endif
+
+	{  NULL , -1 }
+};
+
 /** Conversion table for "Content-Type" header values.
  *
  * Used by rest_response_header for parsing incoming headers.
@@ -239,6 +258,57 @@ typedef struct json_flags {
 	FR_TOKEN op;		//!< The operator that determines how the new VP
 				// is processed. @see fr_tokens_table
 } json_flags_t;
+
+/** States of the incremental JSON body decoder
+ *
+ */
+typedef enum {
+	JSON_STREAM_INIT = 0,	//!< Skipping whitespace before the root object.
+	JSON_STREAM_MEMBER,	//!< Accumulating a "<attribute>":<value> member.
+	JSON_STREAM_DONE,	//!< Root object has been closed.
+	JSON_STREAM_ERROR	//!< Body was malformed, discard what we've decoded.
+} json_stream_state_t;
+
+typedef struct json_stream_vp json_stream_vp_t;
+
+/** A VALUE_PAIR decoded from the body, waiting to be moved into its list
+ *
+ * Pairs aren't inserted into the request until #rest_response_decode is
+ * called, so that the module can still decide what to do with the response
+ * and a malformed body is rejected as a whole.
+ */
+struct json_stream_vp {
+	REQUEST			*current;	//!< Request the list belongs to.
+	pair_lists_t		list;		//!< List to insert the pair into.
+	VALUE_PAIR		*vp;		//!< The pair to insert.
+	json_stream_vp_t	*next;		//!< Next pair in the order they were decoded.
+};
+
+/** Incremental JSON decoder state
+ *
+ * Splits the root object of the body into its members as the data arrives.
+ * Each member is parsed and converted to VALUE_PAIRs as soon as it's complete,
+ * so at most one member is buffered, and only the JSON tree for that member
+ * is ever built.
+ */
+typedef struct json_stream {
+	rlm_rest_t const	*instance;	//!< This instance of rlm_rest.
+	rlm_rest_section_t const *section;	//!< Section the request is being made for.
+
+	json_stream_state_t	state;		//!< Where we are in the root object.
+	int			depth;		//!< Nesting level within the current member.
+	bool			in_string;	//!< Whether we're within a quoted string.
+	bool			escaped;	//!< Whether the previous char was a backslash.
+
+	char			*member;	//!< The member being accumulated, enclosed in {}.
+	size_t			alloc;		//!< Space allocated for the member buffer.
+	size_t			used;		//!< Space used in the member buffer.
+
+	int			max_attrs;	//!< How many more VALUE_PAIRs we may create.
+
+	json_stream_vp_t	*head;		//!< First decoded pair.
+	json_stream_vp_t	**tail;		//!< Where to insert the next decoded pair.
+} json_stream_t;
 #endif
 
 /** Frees a libcurl handle, and any additional memory used by context data.
@@ -974,6 +1044,192 @@ static VALUE_PAIR *json_pair_make_leaf(UNUSED rlm_rest_t const *instance, UNUSED
 	return vp;
 }
 
+/** Converts a single JSON attribute declaration into one or more VALUE_PAIRs
+ *
+ * If stream is NULL, the new VALUE_PAIRs are moved into their lists
+ * immediately, otherwise they're added to the stream's list of pending pairs.
+ *
+ * @see json_pair_make
+ *
+ * @param[in] instance configuration data.
+ * @param[in] section configuration data.
+ * @param[in] request Current request.
+ * @param[in] name of the attribute, may include list and request qualifiers.
+ * @param[in] value of the attribute declaration.
+ * @param[in,out] max_attrs counter, decremented after each VALUE_PAIR is created.
+ * @param[in] stream to add the new VALUE_PAIRs to, may be NULL.
+ * @return
+ *	- 0 on success, or if the declaration was skipped.
+ *	- -1 if we hit the attribute limit.
+ */
+static int json_pair_make_member(rlm_rest_t const *instance, rlm_rest_section_t const *section,
+				 REQUEST *request, char const *name, json_object *value, int *max_attrs,
+				 json_stream_t *stream)
+{
+	int			i = 0, elements;
+	struct json_object	*element, *tmp;
+	TALLOC_CTX		*ctx;
+	vp_tmpl_t		*dst = NULL;
+	int			ret = 0;
+
+	json_flags_t flags = {
+		.op = T_OP_SET,
+		.do_xlat = 1,
+		.is_json = 0
+	};
+
+	REQUEST *current = request;
+	VALUE_PAIR **vps, *vp = NULL;
+
+	/*
+	 *  Resolve attribute name to a dictionary entry and pairlist.
+	 */
+	RDEBUG2("Parsing attribute \"%s\"", name);
+
+	if (tmpl_afrom_attr_str(request, &dst, name, REQUEST_CURRENT, PAIR_LIST_REPLY, false, false) <= 0) {
+		RWDEBUG("Failed parsing attribute: %s, skipping...", fr_strerror());
+		return 0;
+	}
+
+	if (radius_request(&current, dst->tmpl_request) < 0) {
+		RWDEBUG("Attribute name refers to outer request but not in a tunnel, skipping...");
+		goto finish;
+	}
+
+	vps = radius_list(current, dst->tmpl_list);
+	if (!vps) {
+		RWDEBUG("List not valid in this context, skipping...");
+		goto finish;
+	}
+	ctx = radius_list_ctx(current, dst->tmpl_list);
+
+	/*
+	 *  Alternative JSON structure which allows operator,
+	 *  and other flags to be specified.
+	 *
+	 *	"<name>":{
+	 *		"do_xlat":<bool>,
+	 *		"is_json":<bool>,
+	 *		"op":"<op>",
+	 *		"value":<value>
+	 *	}
+	 *
+	 *	Where value is a:
+	 *	  - []	Multivalued array
+	 *	  - {}	Nested Valuepair
+	 *	  - *	Integer or string value
+	 */
+	if (fr_json_object_is_type(value, json_type_object)) {
+		/*
+		 *  Process operator if present.
+		 */
+		if (json_object_object_get_ex(value, "op", &tmp)) {
+			flags.op = fr_str2int(fr_tokens_table, json_object_get_string(tmp), 0);
+			if (!flags.op) {
+				RWDEBUG("Invalid operator value \"%s\", skipping...",
+					json_object_get_string(tmp));
+				goto finish;
+			}
+		}
+
+		/*
+		 *  Process optional do_xlat bool.
+		 */
+		if (json_object_object_get_ex(value, "do_xlat", &tmp)) {
+			flags.do_xlat = json_object_get_boolean(tmp);
+		}
+
+		/*
+		 *  Process optional is_json bool.
+		 */
+		if (json_object_object_get_ex(value, "is_json", &tmp)) {
+			flags.is_json = json_object_get_boolean(tmp);
+		}
+
+		/*
+		 *  Value key must be present if were using the expanded syntax.
+		 */
+		if (!json_object_object_get_ex(value, "value", &tmp)) {
+			RWDEBUG("Value key missing, skipping...");
+			goto finish;
+		}
+	}
+
+	/*
+	 *  Setup fr_pair_make / recursion loop.
+	 */
+	if (!flags.is_json && fr_json_object_is_type(value, json_type_array)) {
+		elements = json_object_array_length(value);
+		if (!elements) {
+			RWDEBUG("Zero length value array, skipping...");
+			goto finish;
+		}
+		element = json_object_array_get_idx(value, 0);
+	} else {
+		elements = 1;
+		element = value;
+	}
+
+	/*
+	 *  A JSON 'value' key, may have multiple elements, iterate
+	 *  over each of them, creating a new VALUE_PAIR.
+	 */
+	do {
+		if ((*max_attrs)-- <= 0) {
+			RWDEBUG("At maximum attribute limit");
+			ret = -1;
+			goto finish;
+		}
+
+		/*
+		 *  Automagically switch the op for multivalued attributes.
+		 */
+		if (((flags.op == T_OP_SET) || (flags.op == T_OP_EQ)) && (i >= 1)) {
+			flags.op = T_OP_ADD;
+		}
+
+		if (fr_json_object_is_type(element, json_type_object) && !flags.is_json) {
+			/* TODO: Insert nested VP into VP structure...*/
+			RWDEBUG("Found nested VP, these are not yet supported, skipping...");
+
+			continue;
+
+			/*
+			vp = json_pair_make(instance, section,
+					   request, value,
+					   level + 1, max_attrs);*/
+		} else {
+			vp = json_pair_make_leaf(instance, section, ctx, request,
+						 dst->tmpl_da, &flags, element);
+			if (!vp) continue;
+		}
+		rdebug_pair(2, request, vp, NULL);
+
+		if (!stream) {
+			radius_pairmove(current, vps, vp, false);
+		} else {
+			json_stream_vp_t *pending;
+
+			pending = talloc_zero(stream, json_stream_vp_t);
+			pending->current = current;
+			pending->list = dst->tmpl_list;
+			pending->vp = vp;
+
+			*stream->tail = pending;
+			stream->tail = &pending->next;
+		}
+	/*
+	 *  If we call json_object_array_get_idx on something that's not an array
+	 *  the behaviour appears to be to occasionally segfault.
+	 */
+	} while ((++i < elements) && (element = json_object_array_get_idx(value, i)));
+
+finish:
+	talloc_free(dst);
+
+	return ret;
+}
+
 /** Processes JSON response and converts it into multiple VALUE_PAIRs
  *
  * Processes JSON attribute declarations in the format below. Will recurse when
@@ -1022,15 +1278,17 @@ static VALUE_PAIR *json_pair_make_leaf(UNUSED rlm_rest_t const *instance, UNUSED
  * @param[in] level Current nesting level.
  * @param[in] max counter, decremented after each VALUE_PAIR is created,
  * 	      when 0 no more attributes will be processed.
+ * @param[in] stream to add the new VALUE_PAIRs to, or NULL to move them
+ *	      into their lists immediately.
  * @return
  *	- Number of attributes created.
  *	- < 0 on error.
  */
 static int json_pair_make(rlm_rest_t const *instance, rlm_rest_section_t const *section,
-			 REQUEST *request, json_object *object, UNUSED int level, int max)
+			 REQUEST *request, json_object *object, UNUSED int level, int max,
+			 json_stream_t *stream)
 {
 	int max_attrs = max;
-	vp_tmpl_t *dst = NULL;
 
 	if (!fr_json_object_is_type(object, json_type_object)) {
 #ifdef HAVE_JSON_TYPE_TO_NAME
@@ -1048,153 +1306,11 @@ static int json_pair_make(rlm_rest_t const *instance, rlm_rest_section_t const *
 	 *	Process VP container
 	 */
 	json_object_object_foreach(object, name, value) {
-		int i = 0, elements;
-		struct json_object *element, *tmp;
-		TALLOC_CTX *ctx;
-
-		json_flags_t flags = {
-			.op = T_OP_SET,
-			.do_xlat = 1,
-			.is_json = 0
-		};
-
-		REQUEST *current = request;
-		VALUE_PAIR **vps, *vp = NULL;
-
-		TALLOC_FREE(dst);
-
-		/*
-		 *  Resolve attribute name to a dictionary entry and pairlist.
-		 */
-		RDEBUG2("Parsing attribute \"%s\"", name);
-
-		if (tmpl_afrom_attr_str(request, &dst, name, REQUEST_CURRENT, PAIR_LIST_REPLY, false, false) <= 0) {
-			RWDEBUG("Failed parsing attribute: %s, skipping...", fr_strerror());
-			continue;
+		if (json_pair_make_member(instance, section, request, name, value, &max_attrs, stream) < 0) {
+			return max;
 		}
-
-		if (radius_request(&current, dst->tmpl_request) < 0) {
-			RWDEBUG("Attribute name refers to outer request but not in a tunnel, skipping...");
-			continue;
-		}
-
-		vps = radius_list(current, dst->tmpl_list);
-		if (!vps) {
-			RWDEBUG("List not valid in this context, skipping...");
-			continue;
-		}
-		ctx = radius_list_ctx(current, dst->tmpl_list);
-
-		/*
-		 *  Alternative JSON structure which allows operator,
-		 *  and other flags to be specified.
-		 *
-		 *	"<name>":{
-		 *		"do_xlat":<bool>,
-		 *		"is_json":<bool>,
-		 *		"op":"<op>",
-		 *		"value":<value>
-		 *	}
-		 *
-		 *	Where value is a:
-		 *	  - []	Multivalued array
-		 *	  - {}	Nested Valuepair
-		 *	  - *	Integer or string value
-		 */
-		if (fr_json_object_is_type(value, json_type_object)) {
-			/*
-			 *  Process operator if present.
-			 */
-			if (json_object_object_get_ex(value, "op", &tmp)) {
-				flags.op = fr_str2int(fr_tokens_table, json_object_get_string(tmp), 0);
-				if (!flags.op) {
-					RWDEBUG("Invalid operator value \"%s\", skipping...",
-						json_object_get_string(tmp));
-					continue;
-				}
-			}
-
-			/*
-			 *  Process optional do_xlat bool.
-			 */
-			if (json_object_object_get_ex(value, "do_xlat", &tmp)) {
-				flags.do_xlat = json_object_get_boolean(tmp);
-			}
-
-			/*
-			 *  Process optional is_json bool.
-			 */
-			if (json_object_object_get_ex(value, "is_json", &tmp)) {
-				flags.is_json = json_object_get_boolean(tmp);
-			}
-
-			/*
-			 *  Value key must be present if were using the expanded syntax.
-			 */
-			if (!json_object_object_get_ex(value, "value", &tmp)) {
-				RWDEBUG("Value key missing, skipping...");
-				continue;
-			}
-		}
-
-		/*
-		 *  Setup fr_pair_make / recursion loop.
-		 */
-		if (!flags.is_json && fr_json_object_is_type(value, json_type_array)) {
-			elements = json_object_array_length(value);
-			if (!elements) {
-				RWDEBUG("Zero length value array, skipping...");
-				continue;
-			}
-			element = json_object_array_get_idx(value, 0);
-		} else {
-			elements = 1;
-			element = value;
-		}
-
-		/*
-		 *  A JSON 'value' key, may have multiple elements, iterate
-		 *  over each of them, creating a new VALUE_PAIR.
-		 */
-		do {
-			if (max_attrs-- <= 0) {
-				RWDEBUG("At maximum attribute limit");
-				return max;
-			}
-
-			/*
-			 *  Automagically switch the op for multivalued attributes.
-			 */
-			if (((flags.op == T_OP_SET) || (flags.op == T_OP_EQ)) && (i >= 1)) {
-				flags.op = T_OP_ADD;
-			}
-
-			if (fr_json_object_is_type(element, json_type_object) && !flags.is_json) {
-				/* TODO: Insert nested VP into VP structure...*/
-				RWDEBUG("Found nested VP, these are not yet supported, skipping...");
-
-				continue;
-
-				/*
-				vp = json_pair_make(instance, section,
-						   request, value,
-						   level + 1, max_attrs);*/
-			} else {
-				vp = json_pair_make_leaf(instance, section, ctx, request,
-							 dst->tmpl_da, &flags, element);
-				if (!vp) continue;
-			}
-			rdebug_pair(2, request, vp, NULL);
-			radius_pairmove(current, vps, vp, false);
-		/*
-		 *  If we call json_object_array_get_idx on something that's not an array
-		 *  the behaviour appears to be to occasionally segfault.
-		 */
-		} while ((++i < elements) && (element = json_object_array_get_idx(value, i)));
 	}
 
-	talloc_free(dst);
-
 	return max - max_attrs;
 }
 
@@ -1239,7 +1355,7 @@ static int rest_decode_json(rlm_rest_t const *instance, rlm_rest_section_t const
 		return -1;
 	}
 
-	ret = json_pair_make(instance, section, request, json, 0, REST_BODY_MAX_ATTRS);
+	ret = json_pair_make(instance, section, request, json, 0, REST_BODY_MAX_ATTRS, NULL);
 
 	/*
 	 *  Decrement reference count for root object, should free entire JSON tree.
@@ -1248,6 +1364,220 @@ static int rest_decode_json(rlm_rest_t const *instance, rlm_rest_section_t const
 
 	return ret;
 }
+
+/** Free any decoded pairs which were never moved into the request
+ *
+ */
+static int _json_stream_free(json_stream_t *stream)
+{
+	json_stream_vp_t *pending;
+
+	for (pending = stream->head; pending; pending = pending->next) talloc_free(pending->vp);
+
+	return 0;
+}
+
+/** Append data to the member buffer
+ *
+ * @param[in] stream decoder state.
+ * @param[in] in data to append.
+ * @param[in] inlen length of data to append.
+ */
+static void json_stream_append(json_stream_t *stream, char const *in, size_t inlen)
+{
+	if ((stream->used + inlen + 1) > stream->alloc) {
+		stream->alloc = stream->used + (((inlen + 1) > REST_BODY_INIT) ? inlen + 1 : REST_BODY_INIT);
+		stream->member = talloc_realloc(stream, stream->member, char, stream->alloc);
+	}
+	memcpy(stream->member + stream->used, in, inlen);
+	stream->used += inlen;
+	stream->member[stream->used] = '\0';
+}
+
+/** Parse the member we've accumulated, and convert it into VALUE_PAIRs
+ *
+ * @param[in] request Current request.
+ * @param[in] stream decoder state.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the member was malformed.
+ */
+static int json_stream_member(REQUEST *request, json_stream_t *stream)
+{
+	char const		*p = stream->member + 1;
+	struct json_object	*json;
+	int			ret;
+
+	/*
+	 *  Nothing between the separators, i.e. "{}" or a trailing comma.
+	 */
+	while (isspace(*p)) p++;
+	if (*p == '\0') goto reset;
+
+	/*
+	 *  Silently discard anything past the attribute limit,
+	 *  json_pair_make has already complained about it.
+	 */
+	if (stream->max_attrs <= 0) goto reset;
+
+	json_stream_append(stream, "}", 1);
+
+	json = json_tokener_parse(stream->member);
+	if (!json) {
+		REDEBUG("Malformed JSON data \"%s\"", stream->member);
+		return -1;
+	}
+
+	ret = json_pair_make(stream->instance, stream->section, request, json, 0, stream->max_attrs, stream);
+	json_object_put(json);
+	if (ret > 0) stream->max_attrs -= ret;
+
+reset:
+	stream->used = 1;
+	stream->member[1] = '\0';
+
+	return 0;
+}
+
+/** Feed body data to the incremental JSON decoder
+ *
+ * Tracks string and nesting state so the root object can be split into
+ * its members.  Each member is decoded as soon as the separator after it
+ * is seen, which means only the current member is ever buffered.
+ *
+ * @param[in] request Current request.
+ * @param[in] stream decoder state.
+ * @param[in] in body data.
+ * @param[in] inlen length of body data.
+ */
+static void rest_decode_json_chunk(REQUEST *request, json_stream_t *stream, char const *in, size_t inlen)
+{
+	char const *p = in, *end = in + inlen, *start;
+
+	if (stream->state == JSON_STREAM_INIT) {
+		while ((p < end) && isspace(*p)) p++;
+		if (p == end) return;
+
+		if (*p != '{') {
+			REDEBUG("Can't process VP container, expected JSON object, skipping...");
+			stream->state = JSON_STREAM_ERROR;
+			return;
+		}
+		p++;
+
+		json_stream_append(stream, "{", 1);
+		stream->state = JSON_STREAM_MEMBER;
+	}
+
+	if (stream->state != JSON_STREAM_MEMBER) return;
+
+	for (start = p; p < end; p++) {
+		if (stream->in_string) {
+			if (stream->escaped) {
+				stream->escaped = false;
+			} else if (*p == '\\') {
+				stream->escaped = true;
+			} else if (*p == '"') {
+				stream->in_string = false;
+			}
+			continue;
+		}
+
+		switch (*p) {
+		case '"':
+			stream->in_string = true;
+			continue;
+
+		case '{':
+		case '[':
+			stream->depth++;
+			continue;
+
+		case '}':
+		case ']':
+			if (stream->depth > 0) {
+				stream->depth--;
+				continue;
+			}
+			if (*p == ']') {
+				REDEBUG("Malformed JSON data, unbalanced ']'");
+				stream->state = JSON_STREAM_ERROR;
+				return;
+			}
+			break;
+
+		case ',':
+			if (stream->depth > 0) continue;
+			break;
+
+		default:
+			continue;
+		}
+
+		/*
+		 *  End of a member at the top level of the root object.
+		 */
+		json_stream_append(stream, start, p - start);
+		if (json_stream_member(request, stream) < 0) {
+			stream->state = JSON_STREAM_ERROR;
+			return;
+		}
+		start = p + 1;
+
+		if (*p == '}') {
+			stream->state = JSON_STREAM_DONE;
+			return;
+		}
+	}
+
+	json_stream_append(stream, start, p - start);
+}
+
+/** Move the VALUE_PAIRs decoded by the incremental JSON decoder into the request
+ *
+ * @see rest_decode_json_chunk
+ *
+ * @param[in] request Current request.
+ * @param[in] stream decoder state.
+ * @return
+ *	- The number of #VALUE_PAIR processed.
+ *	- -1 if the body was malformed.
+ */
+static int rest_decode_json_stream(REQUEST *request, json_stream_t *stream)
+{
+	json_stream_vp_t	*pending;
+	int			count = 0;
+
+	switch (stream->state) {
+	case JSON_STREAM_INIT:
+		return 0;
+
+	case JSON_STREAM_MEMBER:
+		REDEBUG("Malformed JSON data, body ended before the root object was closed");
+		return -1;
+
+	case JSON_STREAM_ERROR:
+		return -1;
+
+	case JSON_STREAM_DONE:
+		break;
+	}
+
+	for (pending = stream->head; pending; pending = pending->next) {
+		VALUE_PAIR **vps;
+
+		vps = radius_list(pending->current, pending->list);
+		if (!vps) {
+			talloc_free(pending->vp);
+		} else {
+			radius_pairmove(pending->current, vps, pending->vp, false);
+		}
+		pending->vp = NULL;
+		count++;
+	}
+
+	return count;
+}
 #endif
 
 /** Processes incoming HTTP header data from libcurl.
@@ -1487,8 +1817,35 @@ static size_t rest_response_body(void *ptr, size_t size, size_t nmemb, void *use
 	 */
 	if (ctx->state == WRITE_STATE_PARSE_HEADERS) {
 		ctx->state = WRITE_STATE_PARSE_CONTENT;
+
+#ifdef HAVE_JSON
+		/*
+		 *  Successful JSON responses are decoded as they arrive,
+		 *  anything else is buffered so it can be logged on error.
+		 */
+		if (ctx->section && (ctx->type == HTTP_BODY_JSON) && (ctx->code >= 200) && (ctx->code < 300)) {
+			json_stream_t *stream;
+
+			stream = talloc_zero(request, json_stream_t);
+			if (!stream) return 0;
+			talloc_set_destructor(stream, _json_stream_free);
+			stream->instance = ctx->instance;
+			stream->section = ctx->section;
+			stream->max_attrs = REST_BODY_MAX_ATTRS;
+			stream->tail = &stream->head;
+
+			ctx->decoder = stream;
+		}
+#endif
 	}
 
+#ifdef HAVE_JSON
+	if (ctx->decoder) {
+		rest_decode_json_chunk(request, ctx->decoder, p, t);
+		return t;
+	}
+#endif
+
 	switch (ctx->type) {
 	case HTTP_BODY_UNSUPPORTED:
 	case HTTP_BODY_UNAVAILABLE:
@@ -1573,6 +1930,8 @@ void rest_response_error(REQUEST *request, rlm_rest_handle_t *handle)
 static void rest_response_init(REQUEST *request, rlm_rest_response_t *ctx, http_body_type_t type)
 {
 	ctx->request = request;
+	ctx->instance = NULL;
+	ctx->section = NULL;
 	ctx->type = type;
 	ctx->state = WRITE_STATE_INIT;
 	ctx->alloc = 0;
@@ -1580,6 +1939,25 @@ static void rest_response_init(REQUEST *request, rlm_rest_response_t *ctx, http_
 	ctx->buffer = NULL;
 }
 
+/** Decode the response body as it arrives, instead of buffering it
+ *
+ * Only JSON responses with a 2xx status code are decoded incrementally, the
+ * body of any other response is still buffered, and available via
+ * #rest_get_handle_data.  Must be called after #rest_request_config.
+ *
+ * @param[in] instance configuration data.
+ * @param[in] section configuration data.
+ * @param[in] handle to decode the response for.
+ */
+void rest_response_stream(rlm_rest_t const *instance, rlm_rest_section_t const *section, void *handle)
+{
+	rlm_rest_handle_t	*randle = handle;
+	rlm_rest_curl_context_t	*ctx = randle->ctx;
+
+	ctx->response.instance = instance;
+	ctx->response.section = section;
+}
+
 /** Extracts pointer to buffer containing response data
  *
  * @param[out] out Where to write the pointer to the buffer.
@@ -1750,6 +2128,22 @@ int rest_request_config(rlm_rest_t const *inst, rlm_rest_thread_t *t, rlm_rest_s
 	SET_OPTION(CURLOPT_PROTOCOLS, (CURLPROTO_HTTP | CURLPROTO_HTTPS));
 #endif
 
+	/*
+	 *	Connection reuse.  Connections are cached by the
+	 *	thread's multi-handle, so are shared by all of
+	 *	the thread's easy handles.
+	 */
+	if (inst->http_version != CURL_HTTP_VERSION_NONE) SET_OPTION(CURLOPT_HTTP_VERSION, inst->http_version);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+	/*
+	 *	Prefer waiting for a multiplexed stream on an
+	 *	existing connection over opening a new one.
+	 */
+	if (inst->multiplex) SET_OPTION(CURLOPT_PIPEWAIT, 1L);
+#endif
+	if (inst->keepalive) SET_OPTION(CURLOPT_TCP_KEEPALIVE, 1L);
+	if (t->share) SET_OPTION(CURLOPT_SHARE, t->share);
+
 	/*
 	 *	FreeRADIUS custom headers
 	 */
@@ -2167,6 +2561,10 @@ int rest_response_decode(rlm_rest_t const *instance, rlm_rest_section_t const *s
 
 	int ret = -1;	/* -Wsometimes-uninitialized */
 
+#ifdef HAVE_JSON
+	if (ctx->response.decoder) return rest_decode_json_stream(request, ctx->response.decoder);
+#endif
+
 	if (!ctx->response.buffer) {
 		RDEBUG2("Skipping attribute processing, no valid body data received");
 		return 0;
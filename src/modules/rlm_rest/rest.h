@@ -98,6 +98,8 @@ extern const FR_NAME_NUMBER http_body_type_table[];
 
 extern const FR_NAME_NUMBER http_content_type_table[];
 
+extern const FR_NAME_NUMBER http_version_table[];
+
 /*
  *	Structure for section configuration
  */
@@ -147,6 +149,17 @@ typedef struct {
 
 	char const		*connect_proxy;	//!< Send request via this proxy.
 
+	char const		*http_version_str;	//!< The string version of the HTTP version.
+	long			http_version;		//!< HTTP version to negotiate (CURL_HTTP_VERSION_*).
+	bool			multiplex;		//!< Multiplex requests to the same origin over
+							//!< a single HTTP/2 connection.
+	uint32_t		max_host_connections;	//!< Maximum connections per origin, per thread.
+							//!< 0 is unlimited.
+	uint32_t		max_total_connections;	//!< Maximum connections, per thread.  0 is unlimited.
+	uint32_t		max_concurrent_streams;	//!< Maximum requests multiplexed over a single
+							//!< HTTP/2 connection.  0 is the libcurl default.
+	bool			keepalive;		//!< Enable TCP keepalive on connections.
+
 	fr_pool_t	*pool;		//!< Pointer to the connection pool.
 
 	rlm_rest_section_t	xlat;		//!< Configuration specific to xlat.
@@ -166,6 +179,8 @@ typedef struct {
 	fr_pool_t		*pool;		//!< Thread specific connection pool.
 	CURLM			*mandle;	//!< Thread specific multi handle.  Serves as the dispatch
 						//!< and coralling structure for REST requests.
+	CURLSH			*share;		//!< DNS and TLS session caches shared by all the easy
+						//!< handles used by this thread.
 	fr_event_list_t		*el;		//!< This thread's event list.
 	fr_event_timer_t const	*ev;		//!< Used to manage IO timers for libcurl.
 	unsigned int		transfers;	//!< Keep track of how many outstanding transfers
@@ -213,6 +228,9 @@ typedef struct {
  */
 typedef struct {
 	rlm_rest_t const	*instance;	//!< This instance of rlm_rest.
+	rlm_rest_section_t const *section;	//!< Section to decode the body for as it arrives.
+						//!< If NULL the body is buffered and decoded
+						//!< by #rest_response_decode.
 	REQUEST			*request;	//!< Current request.
 	write_state_t		state;		//!< Decoder state.
 
@@ -277,6 +295,8 @@ int rest_response_decode(rlm_rest_t const *instance,
 
 void rest_response_error(REQUEST *request, rlm_rest_handle_t *handle);
 
+void rest_response_stream(rlm_rest_t const *instance, rlm_rest_section_t const *section, void *handle);
+
 void rest_request_cleanup(rlm_rest_t const *instance, void *handle);
 
 #define rest_get_handle_code(_handle)(((rlm_rest_curl_context_t*)((rlm_rest_handle_t*)_handle)->ctx)->response.code)
@@ -88,9 +88,20 @@ static const CONF_PARSER xlat_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER http_config[] = {
+	{ FR_CONF_OFFSET("version", FR_TYPE_STRING, rlm_rest_t, http_version_str), .dflt = "default" },
+	{ FR_CONF_OFFSET("multiplex", FR_TYPE_BOOL, rlm_rest_t, multiplex), .dflt = "yes" },
+	{ FR_CONF_OFFSET("max_host_connections", FR_TYPE_UINT32, rlm_rest_t, max_host_connections), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_total_connections", FR_TYPE_UINT32, rlm_rest_t, max_total_connections), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_concurrent_streams", FR_TYPE_UINT32, rlm_rest_t, max_concurrent_streams), .dflt = "0" },
+	{ FR_CONF_OFFSET("keepalive", FR_TYPE_BOOL, rlm_rest_t, keepalive), .dflt = "yes" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_DEPRECATED("connect_timeout", FR_TYPE_TIMEVAL, rlm_rest_t, connect_timeout) },
 	{ FR_CONF_OFFSET("connect_proxy", FR_TYPE_STRING, rlm_rest_t, connect_proxy) },
+	{ FR_CONF_POINTER("http", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) http_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -159,8 +170,14 @@ static int rlm_rest_perform(rlm_rest_t const *instance, rlm_rest_thread_t *threa
 	if (ret < 0) return -1;
 
 	/*
-	 *  Send the CURL request, pre-parse headers, aggregate incoming
-	 *  HTTP body data into a single contiguous buffer.
+	 *  We only need the body if it's an error, or if it's
+	 *  not something we can decode as the data arrives.
+	 */
+	rest_response_stream(instance, section, handle);
+
+	/*
+	 *  Send the CURL request, pre-parse headers, and decode or
+	 *  aggregate incoming HTTP body data.
 	 */
 	ret = rest_io_request_enqueue(thread, request, handle);
 	if (ret < 0) return -1;
@@ -933,6 +950,7 @@ static int mod_thread_detach(void *thread)
 
 	curl_multi_cleanup(t->mandle);
 	fr_pool_free(t->pool);
+	if (t->share) curl_share_cleanup(t->share);
 
 	return 0;
 }
@@ -951,6 +969,12 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	rlm_rest_t *inst = instance;
 
+	inst->http_version = fr_str2int(http_version_table, inst->http_version_str, -1);
+	if (inst->http_version < 0) {
+		cf_log_err(conf, "Invalid HTTP version \"%s\"", inst->http_version_str);
+		return -1;
+	}
+
 	inst->xlat.method_str = "GET";
 	inst->xlat.body = HTTP_BODY_NONE;
 	inst->xlat.body_str = "application/x-www-form-urlencoded";
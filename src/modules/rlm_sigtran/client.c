@@ -88,63 +88,58 @@ static int sigtran_client_do_ctrl_transaction(sigtran_transaction_t *txn)
 	return ret;
 }
 
-/** Called by a new thread to register a new req_pipe
+typedef struct {
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	bool			done;		//!< Set by the event loop when the response is ready.
+} sigtran_client_wait_t;
+
+/** Wake the worker waiting on a queued transaction
  *
- * @return
- *	- The client side of the req_pipe on success.
- *	- -1 on error.
+ * Called by the event loop.
  */
-int sigtran_client_thread_register(void)
+static void _client_queue_complete(sigtran_transaction_t *txn)
 {
-	int			req_pipe[2] = { -1, -1 };
-	sigtran_transaction_t	*txn;
-
-	/*
-	 *	Create the pipe on our side, and pass over
-	 *	the remote end to be registered.
-	 */
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, req_pipe) < 0) {
-		ERROR("Failed creating req_pipe: %s", fr_syserror(errno));
-		return -1;
-	}
-
-	rad_assert((req_pipe[0] >= 0) && (req_pipe[1] >= 0));
-
-	txn = talloc_zero(NULL, sigtran_transaction_t);
-	txn->request.type = SIGTRAN_REQUEST_THREAD_REGISTER;
-	txn->request.data = &req_pipe[1];
-
-	if ((sigtran_client_do_ctrl_transaction(txn) < 0) || (txn->response.type != SIGTRAN_RESPONSE_OK)) {
-		ERROR("Failed registering thread");
-
-		close(req_pipe[0]);
-		close(req_pipe[1]);
-		talloc_free(txn);
-		return -1;
-	}
-	talloc_free(txn);
+	sigtran_client_wait_t *wait = txn->ctx.uctx;
 
-	return req_pipe[0];
+	pthread_mutex_lock(&wait->mutex);
+	wait->done = true;
+	pthread_cond_signal(&wait->cond);
+	pthread_mutex_unlock(&wait->mutex);
 }
 
-/** Signal that libosmo should unregister the other side of the pipe
+/** Queue a transaction for the event loop, and block until it completes
  *
- * @param req_pipe_fd The rlm_sigtran side of the req_pipe.
+ * @param txn to queue.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-int sigtran_client_thread_unregister(int req_pipe_fd)
+static int sigtran_client_do_queue_transaction(sigtran_transaction_t *txn)
 {
-	sigtran_transaction_t	*txn;
+	sigtran_client_wait_t	wait = { .done = false };
 
-	txn = talloc_zero(NULL, sigtran_transaction_t);
-	txn->request.type = SIGTRAN_REQUEST_THREAD_UNREGISTER;
+	pthread_mutex_init(&wait.mutex, NULL);
+	pthread_cond_init(&wait.cond, NULL);
 
-	if ((sigtran_client_do_ctrl_transaction(txn) < 0) || (txn->response.type != SIGTRAN_RESPONSE_OK)) {
-		ERROR("Failed unregistering thread");
-		talloc_free(txn);
+	txn->ctx.complete = _client_queue_complete;
+	txn->ctx.uctx = &wait;
+
+	if (sigtran_event_enqueue(txn) < 0) {
+		pthread_mutex_destroy(&wait.mutex);
+		pthread_cond_destroy(&wait.cond);
 		return -1;
 	}
-	talloc_free(txn);
-	close(req_pipe_fd);
+
+	/*
+	 *	Block until libosmo responds
+	 */
+	pthread_mutex_lock(&wait.mutex);
+	while (!wait.done) pthread_cond_wait(&wait.cond, &wait.mutex);
+	pthread_mutex_unlock(&wait.mutex);
+
+	pthread_mutex_destroy(&wait.mutex);
+	pthread_cond_destroy(&wait.cond);
 
 	return 0;
 }
@@ -198,18 +193,131 @@ int sigtran_client_link_down(sigtran_conn_t const **conn)
 	return 0;
 }
 
+/** Add the attributes for an authentication vector to the control list
+ *
+ * @param request	The current request.
+ * @param cursor	to append attributes with.
+ * @param vec		to convert.  Its buffers are stolen by the new attributes.
+ * @param i		Index of the vector, for debug output.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int sigtran_client_vector_to_pairs(REQUEST *request, vp_cursor_t *cursor, sigtran_vector_t *vec, unsigned int i)
+{
+	VALUE_PAIR		*vp;
+	fr_dict_attr_t const	*root;
+
+	switch (vec->type) {
+	case SIGTRAN_VECTOR_TYPE_SIM_TRIPLETS:
+		rad_assert(vec->sim.rand);
+		rad_assert(vec->sim.sres);
+		rad_assert(vec->sim.kc);
+
+		root = fr_dict_attr_child_by_num(fr_dict_root(fr_dict_internal), FR_EAP_SIM_ROOT);
+		if (!root) {
+			REDEBUG("Can't find dict root for EAP-SIM");
+			return -1;
+		}
+
+		RDEBUG2("SIM auth vector %i", i);
+		RINDENT();
+		vp = fr_pair_afrom_child_num(request, root, FR_EAP_SIM_RAND);
+		fr_pair_value_memsteal(vp, vec->sim.rand);
+		rdebug_pair(L_DBG_LVL_2, request, vp, "&control:");
+		fr_pair_cursor_append(cursor, vp);
+
+		vp = fr_pair_afrom_child_num(request, root, FR_EAP_SIM_SRES);
+		fr_pair_value_memsteal(vp, vec->sim.sres);
+		rdebug_pair(L_DBG_LVL_2, request, vp, "&control:");
+		fr_pair_cursor_append(cursor, vp);
+
+		vp = fr_pair_afrom_child_num(request, root, FR_EAP_SIM_KC);
+		fr_pair_value_memsteal(vp, vec->sim.kc);
+		rdebug_pair(L_DBG_LVL_2, request, vp, "&control:");
+		fr_pair_cursor_append(cursor, vp);
+		REXDENT();
+		break;
+
+	case SIGTRAN_VECTOR_TYPE_UMTS_QUINTUPLETS:
+		rad_assert(vec->umts.rand);
+		rad_assert(vec->umts.xres);
+		rad_assert(vec->umts.ck);
+		rad_assert(vec->umts.ik);
+		rad_assert(vec->umts.authn);
+
+		root = fr_dict_attr_child_by_num(fr_dict_root(fr_dict_internal), FR_EAP_AKA_ROOT);
+		if (!root) {
+			REDEBUG("Can't find dict root for EAP-AKA");
+			return -1;
+		}
+
+		RDEBUG2("UMTS auth vector %i", i);
+		RINDENT();
+		vp = fr_pair_afrom_child_num(request, root, FR_EAP_AKA_RAND);
+		fr_pair_value_memsteal(vp, vec->umts.rand);
+		rdebug_pair(L_DBG_LVL_2, request, vp, "&control:");
+		fr_pair_cursor_append(cursor, vp);
+
+		vp = fr_pair_afrom_child_num(request, root, FR_EAP_AKA_XRES);
+		fr_pair_value_memsteal(vp, vec->umts.xres);
+		rdebug_pair(L_DBG_LVL_2, request, vp, "&control:");
+		fr_pair_cursor_append(cursor, vp);
+
+		vp = fr_pair_afrom_child_num(request, root, FR_EAP_AKA_CK);
+		fr_pair_value_memsteal(vp, vec->umts.ck);
+		rdebug_pair(L_DBG_LVL_2, request, vp, "&control:");
+		fr_pair_cursor_append(cursor, vp);
+
+		vp = fr_pair_afrom_child_num(request, root, FR_EAP_AKA_IK);
+		fr_pair_value_memsteal(vp, vec->umts.ik);
+		rdebug_pair(L_DBG_LVL_2, request, vp, "&control:");
+		fr_pair_cursor_append(cursor, vp);
+
+		vp = fr_pair_afrom_child_num(request, root, FR_EAP_AKA_AUTN);
+		fr_pair_value_memsteal(vp, vec->umts.authn);
+		rdebug_pair(L_DBG_LVL_2, request, vp, "&control:");
+		fr_pair_cursor_append(cursor, vp);
+		REXDENT();
+		break;
+	}
+
+	return 0;
+}
+
+/** Add a list of authentication vectors to the control list
+ *
+ */
+static rlm_rcode_t sigtran_client_vectors_to_pairs(REQUEST *request, sigtran_vector_t *vector)
+{
+	unsigned int		i = 0;
+	vp_cursor_t		cursor;
+	sigtran_vector_t	*vec;
+
+	fr_pair_cursor_init(&cursor, &request->control);
+
+	for (vec = vector; vec; vec = vec->next) {
+		if (sigtran_client_vector_to_pairs(request, &cursor, vec, i++) < 0) return RLM_MODULE_FAIL;
+	}
+
+	return RLM_MODULE_OK;
+}
+
 /** Create a MAP_SEND_AUTH_INFO request
+ *
+ * If the vector cache is enabled, vectors are taken from the cache where possible.
+ * If not, the vectors needed for this authentication are taken from the response,
+ * and the remainder are cached.
  *
  * @param inst		of rlm_sigtran.
  * @param request	The current request.
  * @param conn		current connection.
- * @param fd		file descriptor on which the transaction is done
  * @return
  *	- 0 on success.
  *	- -1 on failure.
  */
-rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t *inst, REQUEST *request,
-					      sigtran_conn_t const *conn, int fd)
+rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t const *inst, REQUEST *request,
+					      sigtran_conn_t const *conn)
 {
 	rlm_rcode_t				rcode;
 	sigtran_transaction_t			*txn;
@@ -217,13 +325,12 @@ rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t *inst, REQUEST *requ
 	char					*imsi;
 	size_t					len;
 
-	rad_assert((fd != ctrl_pipe[0]) && (fd != ctrl_pipe[1]));
-
 	txn = talloc_zero(NULL, sigtran_transaction_t);
 	txn->request.type = SIGTRAN_REQUEST_MAP_SEND_AUTH_INFO;
 
-	req = talloc(txn, sigtran_map_send_auth_info_req_t);
+	req = talloc_zero(txn, sigtran_map_send_auth_info_req_t);
 	req->conn = conn;
+	req->num_vectors = inst->vector_cache_conf.num_vectors;
 
 	if (tmpl_aexpand(request, &req->version, request, inst->conn_conf.map_version, NULL, NULL) < 0) {
 		ERROR("Failed retrieving version");
@@ -261,7 +368,22 @@ rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t *inst, REQUEST *requ
 		goto error;
 	}
 
-	if (sigtran_client_do_transaction(fd, txn) < 0) {
+	/*
+	 *	Use vectors from a previous transaction if
+	 *	there are enough left.
+	 */
+	if (inst->vector_cache) {
+		sigtran_vector_t *vector;
+
+		if (sigtran_vector_cache_get(txn, &vector, inst->vector_cache, request,
+					     req->imsi, req->version) > 0) {
+			rcode = sigtran_client_vectors_to_pairs(request, vector);
+			talloc_free(txn);
+			return rcode;
+		}
+	}
+
+	if (sigtran_client_do_queue_transaction(txn) < 0) {
 		ERROR("Failed sending MAP_SEND_AUTH_INFO request");
 		goto error;
 	}
@@ -272,102 +394,24 @@ rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t *inst, REQUEST *requ
 	switch (txn->response.type) {
 	case SIGTRAN_RESPONSE_OK:
 	{
-		unsigned int		i = 0;
-		vp_cursor_t		cursor;
-		VALUE_PAIR		*vp;
-		sigtran_vector_t	*vec;
 		sigtran_map_send_auth_info_res_t *res = talloc_get_type_abort(txn->response.data,
 									      sigtran_map_send_auth_info_res_t);
-		fr_pair_cursor_init(&cursor, &request->control);
-
-		for (vec = res->vector; vec; vec = vec->next) {
-			switch (vec->type) {
-			case SIGTRAN_VECTOR_TYPE_SIM_TRIPLETS:
-			{
-				fr_dict_attr_t const *root;
-
-				rad_assert(vec->sim.rand);
-				rad_assert(vec->sim.sres);
-				rad_assert(vec->sim.kc);
-
-				root = fr_dict_attr_child_by_num(fr_dict_root(fr_dict_internal), FR_EAP_SIM_ROOT);
-				if (!root) {
-					REDEBUG("Can't find dict root for EAP-SIM");
-					goto error;
-				}
-
-				RDEBUG2("SIM auth vector %i", i);
-				RINDENT();
-				vp = fr_pair_afrom_child_num(request, root, FR_EAP_SIM_RAND);
-				fr_pair_value_memsteal(vp, vec->sim.rand);
-				rdebug_pair(L_DBG_LVL_2, request, vp, "&control:");
-				fr_pair_cursor_append(&cursor, vp);
-
-				vp = fr_pair_afrom_child_num(request, root, FR_EAP_SIM_SRES);
-				fr_pair_value_memsteal(vp, vec->sim.sres);
-				rdebug_pair(L_DBG_LVL_2, request, vp, "&control:");
-				fr_pair_cursor_append(&cursor, vp);
-
-				vp = fr_pair_afrom_child_num(request, root, FR_EAP_SIM_KC);
-				fr_pair_value_memsteal(vp, vec->sim.kc);
-				rdebug_pair(L_DBG_LVL_2, request, vp, "&control:");
-				fr_pair_cursor_append(&cursor, vp);
-				REXDENT();
-
-				i++;
-			}
-				break;
-
-			case SIGTRAN_VECTOR_TYPE_UMTS_QUINTUPLETS:
-			{
-				fr_dict_attr_t const *root;
-
-				rad_assert(vec->umts.rand);
-				rad_assert(vec->umts.xres);
-				rad_assert(vec->umts.ck);
-				rad_assert(vec->umts.ik);
-				rad_assert(vec->umts.authn);
-
-				root = fr_dict_attr_child_by_num(fr_dict_root(fr_dict_internal), FR_EAP_AKA_ROOT);
-				if (!root) {
-					REDEBUG("Can't find dict root for EAP-AKA");
-					goto error;
-				}
-
-				RDEBUG2("UMTS auth vector %i", i);
-				RINDENT();
-				vp = fr_pair_afrom_child_num(request, root, FR_EAP_AKA_RAND);
-				fr_pair_value_memsteal(vp, vec->umts.rand);
-				rdebug_pair(L_DBG_LVL_2, request, vp, "&control:");
-				fr_pair_cursor_append(&cursor, vp);
-
-				vp = fr_pair_afrom_child_num(request, root, FR_EAP_AKA_XRES);
-				fr_pair_value_memsteal(vp, vec->umts.xres);
-				rdebug_pair(L_DBG_LVL_2, request, vp, "&control:");
-				fr_pair_cursor_append(&cursor, vp);
-
-				vp = fr_pair_afrom_child_num(request, root, FR_EAP_AKA_CK);
-				fr_pair_value_memsteal(vp, vec->umts.ck);
-				rdebug_pair(L_DBG_LVL_2, request, vp, "&control:");
-				fr_pair_cursor_append(&cursor, vp);
-
-				vp = fr_pair_afrom_child_num(request, root, FR_EAP_AKA_IK);
-				fr_pair_value_memsteal(vp, vec->umts.ik);
-				rdebug_pair(L_DBG_LVL_2, request, vp, "&control:");
-				fr_pair_cursor_append(&cursor, vp);
-
-				vp = fr_pair_afrom_child_num(request, root, FR_EAP_AKA_AUTN);
-				fr_pair_value_memsteal(vp, vec->umts.authn);
-				rdebug_pair(L_DBG_LVL_2, request, vp, "&control:");
-				fr_pair_cursor_append(&cursor, vp);
-				REXDENT();
-
-				i++;
-			}
-				break;
-			}
+
+		/*
+		 *	Keep the vectors this authentication
+		 *	doesn't need for the next one.
+		 */
+		if (inst->vector_cache) {
+			sigtran_vector_t	**last = &res->vector;
+			unsigned int		i;
+
+			for (i = sigtran_vector_per_auth(req->version); *last && (i > 0); i--) last = &(*last)->next;
+
+			sigtran_vector_cache_add(inst->vector_cache, req->imsi, req->version, *last);
+			*last = NULL;
 		}
-		rcode = RLM_MODULE_OK;
+
+		rcode = sigtran_client_vectors_to_pairs(request, res->vector);
 	}
 		break;
 
@@ -42,6 +42,12 @@
  * FDs libosmo* creates, and a pipe we create (to allow communication
  * with worker threads).
  *
+ * MAP requests from workers are appended to a shared request queue.  Only
+ * the worker which finds the queue empty writes to the queue pipe to wake
+ * this thread, which then takes every queued request in one go, so under
+ * load many requests are handed over for each wakeup.  Workers are told a
+ * request completed via the transaction's completion callback.
+ *
  * You might except performance using this model to be terrible.  But the
  * fact that libosmo is entirely async, and there's no heavy crypto being
  * performed, I suspect that this thread is unlikely to become a bottleneck.
@@ -74,6 +80,10 @@
 #include "sigtran.h"
 
 int			ctrl_pipe[2] = { -1, -1 };	/* Pipes are unidirectional */
+static int		queue_pipe[2] = { -1, -1 };	/* Wakes the event loop when requests are queued */
+static pthread_mutex_t	queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sigtran_transaction_t *queue_head = NULL;	/* Requests waiting for the event loop */
+static sigtran_transaction_t **queue_tail = &queue_head;
 static pthread_t	event_thread;
 static sem_t		event_thread_running;
 static bool		do_exit = false;
@@ -277,6 +287,16 @@ int sigtran_event_submit(struct osmo_fd *ofd, sigtran_transaction_t *txn)
 	uint8_t buff[sizeof(void *)];
 	uint8_t *p = buff, *end = buff + sizeof(buff);
 
+	/*
+	 *	Queued requests are completed by callback,
+	 *	nothing is listening on the other end of
+	 *	the queue pipe.
+	 */
+	if (txn && txn->ctx.complete) {
+		txn->ctx.complete(txn);
+		return 0;
+	}
+
 	memcpy(buff, &txn, sizeof(buff));
 
 	for (p = buff; p < end; p++) {
@@ -321,13 +341,13 @@ int sigtran_event_submit(struct osmo_fd *ofd, sigtran_transaction_t *txn)
 	return 0;
 }
 
-/** Processes a request for a new pipe from a worker thread
+/** Processes a control request from the ctrl_pipe
  *
  * @param ofd	for the main ctrl_pipe.
  * @param what	happened.
  * @return
- *	- 0 on success, with pointer written to registration pipe for new osmo_fd.
- *	- -1 on error, with NULL pointer written to registration pipe.
+ *	- 0 on success, with the transaction pointer written back to the ctrl_pipe.
+ *	- -1 on error, with NULL pointer written back to the ctrl_pipe.
  */
 static int event_request_handle(struct osmo_fd *ofd, unsigned int what)
 {
@@ -369,32 +389,6 @@ static int event_request_handle(struct osmo_fd *ofd, unsigned int what)
 	txn = talloc_get_type_abort(ptr, sigtran_transaction_t);
 	txn->ctx.ofd = ofd;
 	switch (txn->request.type) {
-	case SIGTRAN_REQUEST_THREAD_REGISTER:
-	{
-		struct osmo_fd	*req_ofd;
-		int		fd;
-
-		fd = *((int *)txn->request.data);	/* Not talloced */
-
-		DEBUG3("Registering req_pipe (%i)", fd);
-
-		req_ofd = ofd_create(ofd->data, fd, event_request_handle, NULL);
-		if (!req_ofd) {
-			txn->response.type = SIGTRAN_RESPONSE_FAIL;
-		} else {
-			txn->response.type = SIGTRAN_RESPONSE_OK;
-		}
-	}
-		break;
-
-	case SIGTRAN_REQUEST_THREAD_UNREGISTER:
-		DEBUG3("Deregistering req_pipe (%i).  Signalled by worker", ofd->fd);
-		txn->response.type = SIGTRAN_RESPONSE_OK;
-
-		if (sigtran_event_submit(ofd, txn) < 0) goto fatal_error;
-		talloc_free(ofd);	/* Ordering is important */
-		return 0;
-
 	case SIGTRAN_REQUEST_LINK_UP:
 		DEBUG3("Bringing link up");
 		if (event_link_up(ofd->data, (sigtran_conn_t **)&txn->response.data, txn->request.data) < 0) {	/* Struct not talloced */
@@ -413,19 +407,6 @@ static int event_request_handle(struct osmo_fd *ofd, unsigned int what)
 		}
 		break;
 
-	case SIGTRAN_REQUEST_MAP_SEND_AUTH_INFO:
-	{
-		sigtran_map_send_auth_info_req_t *req = talloc_get_type_abort(txn->request.data,
-									      sigtran_map_send_auth_info_req_t);
-		DEBUG3("Processing map send auth info");
-		if (sigtran_tcap_outgoing(NULL, req->conn, txn, ofd) < 0) {
-			txn->response.type = SIGTRAN_RESPONSE_FAIL;
-		} else {
-			return 0;	/* Keep caller blocked until we get a response */
-		}
-	}
-		break;
-
 	case SIGTRAN_REQUEST_EXIT:
 		DEBUG3("Event loop will exit");
 		do_exit = true;
@@ -448,6 +429,142 @@ static int event_request_handle(struct osmo_fd *ofd, unsigned int what)
 	return 0;
 }
 
+/** Queue a request for the event loop
+ *
+ * The transaction must have a completion callback, which will be called
+ * from the event loop thread once the request has been processed.
+ *
+ * @param[in] txn	to queue.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sigtran_event_enqueue(sigtran_transaction_t *txn)
+{
+	bool	wake;
+	uint8_t	c = 0;
+
+	rad_assert(txn->ctx.complete);
+
+	if (queue_pipe[0] < 0) {
+		ERROR("Event loop not running");
+		return -1;
+	}
+
+	txn->ctx.next = NULL;
+
+	pthread_mutex_lock(&queue_mutex);
+	wake = (queue_head == NULL);
+	*queue_tail = txn;
+	queue_tail = &txn->ctx.next;
+	pthread_mutex_unlock(&queue_mutex);
+
+	/*
+	 *	If the queue wasn't empty, the event loop
+	 *	has already been woken, and will pick this
+	 *	request up along with the others.
+	 */
+	if (!wake) return 0;
+
+	if ((write(queue_pipe[0], &c, sizeof(c)) < 0) && (errno != EAGAIN)) {
+		ERROR("queue_pipe (%i) write failed: %s", queue_pipe[0], fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Take every queued request
+ *
+ * @return the list of requests, in the order they were queued.
+ */
+static sigtran_transaction_t *event_queue_take(void)
+{
+	sigtran_transaction_t *head;
+
+	pthread_mutex_lock(&queue_mutex);
+	head = queue_head;
+	queue_head = NULL;
+	queue_tail = &queue_head;
+	pthread_mutex_unlock(&queue_mutex);
+
+	return head;
+}
+
+/** Process all the requests in the request queue
+ *
+ * @param ofd	for the queue_pipe.
+ * @param what	happened.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+static int event_queue_handle(struct osmo_fd *ofd, unsigned int what)
+{
+	sigtran_transaction_t	*txn, *next;
+	uint8_t			buff[64];
+	unsigned int		count = 0;
+
+	if (what & BSC_FD_EXCEPT) {
+		ERROR("pipe (%i) closed by server, eventer thread exiting", ofd->fd);
+		do_exit = true;
+		return -1;
+	}
+
+	if (!(what & BSC_FD_READ)) return 0;
+
+	/*
+	 *	Drain the wakeups before taking the queue,
+	 *	so that a wakeup for a request queued after
+	 *	the take isn't lost.
+	 */
+	while (read(ofd->fd, buff, sizeof(buff)) == sizeof(buff));
+
+	for (txn = event_queue_take(); txn; txn = next) {
+		next = txn->ctx.next;
+		txn->ctx.next = NULL;
+		txn->ctx.ofd = ofd;
+		count++;
+
+		switch (txn->request.type) {
+		case SIGTRAN_REQUEST_MAP_SEND_AUTH_INFO:
+		{
+			sigtran_map_send_auth_info_req_t *req = talloc_get_type_abort(txn->request.data,
+										      sigtran_map_send_auth_info_req_t);
+			if (sigtran_tcap_outgoing(NULL, req->conn, txn, ofd) == 0) continue;	/* Completed on response */
+
+			txn->response.type = SIGTRAN_RESPONSE_FAIL;
+		}
+			break;
+
+		default:
+			rad_assert(0);
+			txn->response.type = SIGTRAN_RESPONSE_FAIL;
+			break;
+		}
+
+		txn->ctx.complete(txn);
+	}
+
+	DEBUG3("Processed %u queued request(s)", count);
+
+	return 0;
+}
+
+/** Fail any requests left in the queue when the event loop exits
+ *
+ */
+static void event_queue_fail(void)
+{
+	sigtran_transaction_t *txn, *next;
+
+	for (txn = event_queue_take(); txn; txn = next) {
+		next = txn->ctx.next;
+		txn->response.type = SIGTRAN_RESPONSE_FAIL;
+		txn->ctx.complete(txn);
+	}
+}
+
 /** Enter the libosmo event loop
  *
  * Will run until the thread is killed, or signalled to exit on the ctrl_pipe.
@@ -469,6 +586,14 @@ static void *sigtran_event_loop(UNUSED void *instance)
 	}
 	if (!ofd_create(ctx, ctrl_pipe[1], event_request_handle, ctx)) return NULL;
 
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, queue_pipe) < 0) {
+		ERROR("Failed creating queue_pipe: %s", fr_syserror(errno));
+		return NULL;
+	}
+	fr_nonblock(queue_pipe[0]);
+	fr_nonblock(queue_pipe[1]);
+	if (!ofd_create(ctx, queue_pipe[1], event_queue_handle, ctx)) return NULL;
+
 	DEBUG2("Entering oscmocore event loop, listening on fd %i (client fd %i)", ctrl_pipe[1], ctrl_pipe[0]);
 
 	sem_post(&event_thread_running);		/* Up enough to be ok! */
@@ -478,7 +603,9 @@ static void *sigtran_event_loop(UNUSED void *instance)
 	 */
 	while (!do_exit) osmo_select_main(0);
 
-	talloc_free(ctx);	/* Also frees ctrl pipe ofd (which closes ctrl_pipe[1]) */
+	event_queue_fail();
+
+	talloc_free(ctx);	/* Also frees ctrl pipe and queue pipe ofds (which closes ctrl_pipe[1] and queue_pipe[1]) */
 
 	DEBUG2("osmocore event loop exiting");
 
@@ -549,6 +676,10 @@ int sigtran_event_exit(void)
 
 	pthread_join(event_thread, NULL);
 
+	close(queue_pipe[0]);
+	queue_pipe[0] = -1;
+	queue_pipe[1] = -1;
+
 	sigtran_sccp_global_free();
 
 	return 0;
@@ -62,8 +62,6 @@ static uint32_t	sigtran_instances = 0;
 
 unsigned int __hack_opc, __hack_dpc;
 
-fr_thread_local_setup(int *, req_pipe);
-
 static const FR_NAME_NUMBER m3ua_traffic_mode_table[] = {
 	{ "override",  1 },
 	{ "loadshare", 2 },
@@ -144,53 +142,33 @@ static const CONF_PARSER map_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER vector_cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_sigtran_t, vector_cache_conf.max_entries), .dflt = "1024" },
+	{ FR_CONF_OFFSET("num_vectors", FR_TYPE_UINT32, rlm_sigtran_t, vector_cache_conf.num_vectors), .dflt = "5" },
+	{ FR_CONF_OFFSET("refill_threshold", FR_TYPE_UINT32, rlm_sigtran_t, vector_cache_conf.refill_threshold), .dflt = "3" },
+	{ FR_CONF_OFFSET("lifetime", FR_TYPE_UINT32, rlm_sigtran_t, vector_cache_conf.lifetime), .dflt = "300" },
+
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_POINTER("sctp", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) sctp_config },
 	{ FR_CONF_POINTER("m3ua", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) m3ua_config },
 	{ FR_CONF_POINTER("mtp3", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) mtp3_config },
 	{ FR_CONF_POINTER("sccp", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) sccp_config },
 	{ FR_CONF_POINTER("map", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) map_config },
+	{ FR_CONF_POINTER("vector_cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) vector_cache_config },
 
 	{ FR_CONF_OFFSET("imsi", FR_TYPE_TMPL | FR_TYPE_REQUIRED, rlm_sigtran_t, imsi) },
 
 	CONF_PARSER_TERMINATOR
 };
 
-/** Signal the multiplexer that this thread is exiting
- *
- */
-static void _req_pipe_unregister(void *fd_ptr)
-{
-	int fd = *talloc_get_type_abort(fd_ptr, int);
-
-	sigtran_client_thread_unregister(fd);	/* Also closes our side */
-}
-
 static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_sigtran_t const	*inst = instance;
-	int			*fd_ptr, fd;
-
-	/*
-	 *	Retrieve the thread specific pipe we use
-	 *	to communicate with the multiplexer.
-	 */
-	fd_ptr = req_pipe;
-	if (!fd_ptr) {
-		fd_ptr = talloc(NULL, int);
-		fd = sigtran_client_thread_register();
-		if (fd < 0) {
-			RERROR("Failed registering thread with multiplexer");
-			talloc_free(fd_ptr);
-			return RLM_MODULE_FAIL;
-		}
-		*fd_ptr = fd;
-		fr_thread_local_set_destructor(req_pipe, _req_pipe_unregister, fd_ptr);
-	} else {
-		fd = *fd_ptr;
-	}
 
-	return sigtran_client_map_send_auth_info(inst, request, inst->conn, fd);
+	return sigtran_client_map_send_auth_info(inst, request, inst->conn);
 }
 
 
@@ -331,6 +309,9 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	MTP3_PC_CHECK(dpc);
 	MTP3_PC_CHECK(opc);
 
+	FR_INTEGER_BOUND_CHECK("vector_cache.num_vectors", inst->vector_cache_conf.num_vectors, >=, 1);
+	FR_INTEGER_BOUND_CHECK("vector_cache.num_vectors", inst->vector_cache_conf.num_vectors, <=, 5);
+
 	if (sigtran_sccp_sockaddr_from_conf(inst, inst, &inst->conn_conf.sccp_called_sockaddr,
 					    &inst->conn_conf.sccp_called, conf) < 0) return -1;
 	if (sigtran_sccp_sockaddr_from_conf(inst, inst, &inst->conn_conf.sccp_calling_sockaddr,
@@ -341,8 +322,9 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	 *	We spawn a new thread to run all the libosmo-* I/O
 	 *	and events.
 	 *
-	 *	We talk to the thread using the ctrl_pipe, with
-	 *	each thread registering its own pipe via the ctrl_pipe.
+	 *	We talk to the thread using the ctrl_pipe for
+	 *	control operations, and a shared queue for MAP
+	 *	requests from the workers.
 	 *
 	 *	This makes it really easy to collect and distribute
 	 *	requests/responses, whilst using libosmo in a
@@ -356,6 +338,14 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	 */
 	if (sigtran_client_link_up(&inst->conn, &inst->conn_conf) < 0) return -1;
 
+	if (inst->vector_cache_conf.max_entries > 0) {
+		inst->vector_cache = sigtran_vector_cache_alloc(inst, &inst->vector_cache_conf, inst->conn);
+		if (!inst->vector_cache) {
+			cf_log_err(conf, "Failed creating vector cache");
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -366,6 +356,13 @@ static int mod_detach(UNUSED void *instance)
 {
 	rlm_sigtran_t *inst = instance;
 
+	/*
+	 *	Refills reference the connection, so
+	 *	wait for them before taking it down.
+	 */
+	sigtran_vector_cache_free(inst->vector_cache);
+	inst->vector_cache = NULL;
+
 	sigtran_client_link_down(&inst->conn);
 
 	if ((--sigtran_instances) == 0) sigtran_event_exit();
@@ -76,7 +76,7 @@ static void sigtran_tcap_timeout(void *data)
 
 	request = txn->ctx.request;
 
-	REDEBUG("OTID %u Invoke ID %u timeout", txn->ctx.otid, txn->ctx.invoke_id);
+	ROPTIONAL(REDEBUG, ERROR, "OTID %u Invoke ID %u timeout", txn->ctx.otid, txn->ctx.invoke_id);
 
 	/*
 	 *	Remove the outstanding transaction
@@ -95,6 +95,8 @@ static void sigtran_tcap_timeout(void *data)
  *
  * SCCP will add its headers and call sigtran_sccp_outgoing
  *
+ * @note txn->ctx.request is NULL for vector refills, as no request is waiting.
+ *
  * @return
  *	- 0 on success.
  *	- <0 on failure.
@@ -137,39 +139,45 @@ int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transac
 	rad_assert(req->imsi);
 
 	if (!mtp_m3ua_link_is_up(m3ua_client)) {
-		REDEBUG("Link not yet active, dropping the request");
+		ROPTIONAL(REDEBUG, ERROR, "Link not yet active, dropping the request");
 
 		return -1;
 	}
 
 	if (rbtree_num_elements(txn_tree) > UINT8_MAX) {
-		REDEBUG("Too many outstanding requests, dropping the request");
+		ROPTIONAL(REDEBUG, ERROR, "Too many outstanding requests, dropping the request");
 
 		return -1;
 	}
 
 	switch (req->version) {
 	case 2:
-		RDEBUG4("Allocating buffer for MAP v2, %zu bytes", sizeof(tcap_map_raw_v2));
+		ROPTIONAL(RDEBUG4, DEBUG4, "Allocating buffer for MAP v2, %zu bytes", sizeof(tcap_map_raw_v2));
 		msg = msgb_alloc(sizeof(tcap_map_raw_v2), "sccp: tcap_map");
 		msg->l3h = msgb_put(msg, sizeof(tcap_map_raw_v2));
 		memcpy(msg->l3h, tcap_map_raw_v2, sizeof(tcap_map_raw_v2));
 
 		*(msg->l3h + 0x3a) = talloc_array_length(req->imsi);
 		memcpy(msg->l3h + 0x3b, req->imsi, talloc_array_length(req->imsi));
-		RHEXDUMP(0, msg->l3h, sizeof(tcap_map_raw_v2), "MAPv2 Request");
+		if (request) RHEXDUMP(0, msg->l3h, sizeof(tcap_map_raw_v2), "MAPv2 Request");
 
 		break;
 
 	case 3:
-		RDEBUG4("Allocating buffer for MAP v3, %zu bytes", sizeof(tcap_map_raw_v3));
+		ROPTIONAL(RDEBUG4, DEBUG4, "Allocating buffer for MAP v3, %zu bytes", sizeof(tcap_map_raw_v3));
 		msg = msgb_alloc(sizeof(tcap_map_raw_v3), "sccp: tcap_map");
 		msg->l3h = msgb_put(msg, sizeof(tcap_map_raw_v3));
 		memcpy(msg->l3h, tcap_map_raw_v3, sizeof(tcap_map_raw_v3));
 
 		*(msg->l3h + 0x3c) = talloc_array_length(req->imsi);
 		memcpy(msg->l3h + 0x3d, req->imsi, talloc_array_length(req->imsi));
-		RHEXDUMP(0, msg->l3h, sizeof(tcap_map_raw_v3), "MAPv3 Request");
+
+		/*
+		 *	numberOfRequestedVectors (1-5).  MAP v2 has no
+		 *	equivalent, the HLR decides how many to send.
+		 */
+		if (req->num_vectors) *(msg->l3h + 0x47) = req->num_vectors;
+		if (request) RHEXDUMP(0, msg->l3h, sizeof(tcap_map_raw_v3), "MAPv3 Request");
 
 		break;
 
@@ -184,20 +192,14 @@ int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transac
 
 	txn->ctx.invoke_id++;						/* Needs to be two operations */
 	txn->ctx.invoke_id &= 0x7f;					/* Invoke ID is 7bits */
-	RDEBUG2("Sending request with OTID %u Invoke ID %u", txn->ctx.otid, txn->ctx.invoke_id);
+	ROPTIONAL(RDEBUG2, DEBUG2, "Sending request with OTID %u Invoke ID %u", txn->ctx.otid, txn->ctx.invoke_id);
 
 	if (!rbtree_insert(txn_tree, txn)) {
-		RERROR("Failed inserting transaction, maybe at txn limit?");
+		ROPTIONAL(RERROR, ERROR, "Failed inserting transaction, maybe at txn limit?");
 
 		msgb_free(msg);
 
-		txn->response.type = SIGTRAN_RESPONSE_FAIL;
-
-		if (sigtran_event_submit(ofd, txn) < 0) {
-			ERROR("Failed informing event client of result: %s", fr_syserror(errno));
-			return -1;
-		}
-		return -1;
+		return -1;	/* Caller responds */
 	}
 
 	/*
@@ -283,10 +285,10 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 #define sigtran_memdup(_x) \
 	do { \
 		p++; \
-		RDEBUG4("Start 0x%02x len %u", (unsigned int)(tcap - p), p[0]); \
+		ROPTIONAL(RDEBUG4, DEBUG4, "Start 0x%02x len %u", (unsigned int)(tcap - p), p[0]); \
 		if (p[0] >= (len - (p - tcap))) { \
-			REDEBUG("Invalid length %u specified for vector component", p[0]); \
-			return -1; \
+			ROPTIONAL(REDEBUG, ERROR, "Invalid length %u specified for vector component", p[0]); \
+			goto error; \
 		} \
 		vec->_x = talloc_memdup(vec, p + 1, p[0]); \
 		p += p[0] + 1; \
@@ -304,7 +306,7 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 		p = tcap + 0x40;
 		while (p < end) {
 			if ((p[0] != 0x30) || (p[1] != 0x22)) {
-				RDEBUG4("Breaking out of parsing loop at %x", (uint32_t)(p - tcap));
+				ROPTIONAL(RDEBUG4, DEBUG4, "Breaking out of parsing loop at %x", (uint32_t)(p - tcap));
 				break;
 			}
 			p += 2;
@@ -331,8 +333,36 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 		sigtran_memdup(umts.authn);
 
 		*last = vec;
+		last = &(vec->next);
+
+		/*
+		 *	Any additional quintuplets we asked for
+		 *	follow, each in its own SEQUENCE.
+		 */
+		while (((p + 2) < end) && (p[0] == 0x30)) {
+			p += 2;
+
+			MEM(vec = talloc_zero(res, sigtran_vector_t));
+			vec->type = SIGTRAN_VECTOR_TYPE_UMTS_QUINTUPLETS;
+			sigtran_memdup(umts.rand);
+			sigtran_memdup(umts.xres);
+			sigtran_memdup(umts.ck);
+			sigtran_memdup(umts.ik);
+			sigtran_memdup(umts.authn);
+
+			*last = vec;
+			last = &(vec->next);
+		}
 	}
 
+	goto submit;
+
+error:
+	txn->response.type = SIGTRAN_RESPONSE_FAIL;
+	txn->response.data = NULL;
+	talloc_free(res);
+
+submit:
 	if (sigtran_event_submit(ofd, txn) < 0) {
 		ERROR("Failed informing event client of result: %s", fr_syserror(errno));
 		return -1;
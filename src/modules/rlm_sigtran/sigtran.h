@@ -40,8 +40,6 @@
 #include <osmocom/core/select.h>
 
 typedef enum {
-	SIGTRAN_REQUEST_THREAD_REGISTER,				//!< New worker thread to register.
-	SIGTRAN_REQUEST_THREAD_UNREGISTER,				//!< Worker thread to unregister.
 	SIGTRAN_REQUEST_LINK_UP,					//!< Bring up a link.
 	SIGTRAN_REQUEST_LINK_DOWN,					//!< Take down a link.
 	SIGTRAN_REQUEST_MAP_SEND_AUTH_INFO,				//!< Request auth info.
@@ -66,13 +64,24 @@ typedef enum {
 	SIGTRAN_VECTOR_TYPE_UMTS_QUINTUPLETS				//!< RAND, XRES, CK, IK, AUTN.
 } sigtran_vector_type_t;
 
+typedef struct sigtran_transaction sigtran_transaction_t;
+
+/** Called by the event loop when a queued transaction completes
+ *
+ * @param[in] txn	that completed.  txn->response is populated.
+ */
+typedef void (*sigtran_transaction_complete_t)(sigtran_transaction_t *txn);
+
 /** Request and response from the event loop
  *
  * We allocate the whole thing on the client side, as the client
  * will be blocked waiting on the response from the event loop,
  * and won't mind extra memory being allocated from this ctx.
+ *
+ * The exception is vector refills, which nothing waits for.  Those
+ * are freed by their completion callback.
  */
-typedef struct sigtran_transaction {
+struct sigtran_transaction {
 	struct {
 		sigtran_request_type_t		type;			//!< Type of request
 		void				*data;			//!< Data for the request.
@@ -90,8 +99,13 @@ typedef struct sigtran_transaction {
 
 		uint32_t		otid;		//!< Transaction ID.
 		uint8_t			invoke_id;	//!< Sequence number (within transaction).
+
+		sigtran_transaction_complete_t	complete;	//!< Called instead of writing the
+								//!< response to ofd.
+		void			*uctx;		//!< Data for the completion callback.
+		sigtran_transaction_t	*next;		//!< Next transaction in the request queue.
 	} ctx;
-} sigtran_transaction_t;
+};
 
 typedef struct sigtran_sccp_global_title {
 	char const			*address;			//!< Address digits.
@@ -223,6 +237,20 @@ typedef struct sigtran_map_send_auth_info_res {
 	sigtran_vector_t	*vector;				//!< Linked list of vectors.
 } sigtran_map_send_auth_info_res_t;
 
+/** Configures the per-IMSI vector cache
+ *
+ */
+typedef struct sigtran_vector_cache_conf {
+	uint32_t		max_entries;				//!< Maximum number of IMSIs to cache
+									//!< vectors for.  0 disables the cache.
+	uint32_t		num_vectors;				//!< Vectors to request per transaction.
+	uint32_t		refill_threshold;			//!< Refill when fewer than this many
+									//!< vectors remain.
+	uint32_t		lifetime;				//!< How long vectors may be cached for.
+} sigtran_vector_cache_conf_t;
+
+typedef struct sigtran_vector_cache sigtran_vector_cache_t;
+
 typedef struct rlm_sigtran {
 	char const		*name;					//!< Instance name.
 
@@ -231,6 +259,10 @@ typedef struct rlm_sigtran {
 	sigtran_conn_conf_t	conn_conf;				//!< Connection configuration
 
 	vp_tmpl_t		*imsi;					//!< Subscriber identifier.
+
+	sigtran_vector_cache_conf_t vector_cache_conf;			//!< Vector cache configuration.
+	sigtran_vector_cache_t	*vector_cache;				//!< Vectors left over from previous
+									//!< transactions.
 } rlm_sigtran_t;
 
 extern int ctrl_pipe[2];
@@ -242,16 +274,12 @@ extern uint8_t const is_char_tbcd[];
  */
 int	sigtran_client_do_transaction(int fd, sigtran_transaction_t *txn);
 
-int	sigtran_client_thread_register(void);
-
-int	sigtran_client_thread_unregister(int req_pipe_fd);
-
 int	sigtran_client_link_up(sigtran_conn_t const **out, sigtran_conn_conf_t const *conf);
 
 int	sigtran_client_link_down(sigtran_conn_t const **conn);
 
-rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t *inst, REQUEST *request,
-					      sigtran_conn_t const *conn, int fd);
+rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t const *inst, REQUEST *request,
+					      sigtran_conn_t const *conn);
 
 /*
  *	event.c
@@ -262,6 +290,8 @@ int	sigtran_event_exit(void);
 
 int	sigtran_event_submit(struct osmo_fd *ofd, sigtran_transaction_t *txn);
 
+int	sigtran_event_enqueue(sigtran_transaction_t *txn);
+
 /*
  *	sccp.c
  */
@@ -283,6 +313,22 @@ int	sigtran_sccp_global_title(TALLOC_CTX *ctx, uint8_t **out, int gt_ind, char c
 
 int	sigtran_ascii_to_tbcd(TALLOC_CTX *ctx, uint8_t **out, char const *ascii);
 
+/*
+ *	vector.c
+ */
+sigtran_vector_cache_t *sigtran_vector_cache_alloc(TALLOC_CTX *ctx, sigtran_vector_cache_conf_t const *conf,
+						   sigtran_conn_t const *conn);
+
+void	sigtran_vector_cache_free(sigtran_vector_cache_t *cache);
+
+unsigned int sigtran_vector_per_auth(uint8_t version);
+
+unsigned int sigtran_vector_cache_get(TALLOC_CTX *ctx, sigtran_vector_t **out, sigtran_vector_cache_t *cache,
+				      REQUEST *request, uint8_t const *imsi, uint8_t version);
+
+void	sigtran_vector_cache_add(sigtran_vector_cache_t *cache, uint8_t const *imsi, uint8_t version,
+				 sigtran_vector_t *vector);
+
 /*
  *	log.c
  */
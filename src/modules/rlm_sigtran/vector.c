@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2016, Network RADIUS SARL <license@networkradius.com>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of Network RADIUS SARL nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * $Id$
+ * @file rlm_sigtran/vector.c
+ * @brief Cache authentication vectors between MAP transactions.
+ *
+ * Each MAP SendAuthInfo transaction requests several vectors.  Only the ones
+ * needed for the current authentication are used, the rest are stored here,
+ * keyed by IMSI, for the subscriber's next authentication.
+ *
+ * When the number of vectors cached for an IMSI falls below the refill threshold,
+ * another transaction is queued for the event loop.  Nothing waits for it, so the
+ * HLR round trip is hidden from the subscriber as long as they don't
+ * reauthenticate faster than the HLR can respond.
+ *
+ * Vectors must only be used once, so they're removed from the cache as they're
+ * handed out.
+ *
+ * @copyright 2017 Network RADIUS SARL <license@networkradius.com>
+ */
+#define LOG_PREFIX "rlm_sigtran - "
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/talloc.h>
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "sigtran.h"
+
+typedef struct sigtran_vector_entry sigtran_vector_entry_t;
+
+/** Vectors cached for a single IMSI
+ *
+ */
+struct sigtran_vector_entry {
+	sigtran_vector_cache_t	*cache;			//!< Cache this entry belongs to.
+
+	uint8_t			*imsi;			//!< BCD encoded IMSI.
+	uint8_t			version;		//!< MAP version the vectors were retrieved with.
+
+	sigtran_vector_t	*head;			//!< Oldest vector.
+	sigtran_vector_t	**tail;			//!< Where to append new vectors.
+	unsigned int		count;			//!< Number of vectors in the list.
+
+	bool			refilling;		//!< A refill transaction is outstanding.
+	time_t			expires;		//!< When the vectors should be discarded.
+
+	sigtran_vector_entry_t	*prev;			//!< Previous entry in order of expiry.
+	sigtran_vector_entry_t	*next;			//!< Next entry in order of expiry.
+};
+
+struct sigtran_vector_cache {
+	sigtran_vector_cache_conf_t const *conf;	//!< Cache configuration.
+	sigtran_conn_t const	*conn;			//!< Connection to send refills on.
+
+	pthread_mutex_t		mutex;			//!< Protects everything below.
+	pthread_cond_t		refilled;		//!< Signalled when the last refill completes.
+
+	rbtree_t		*tree;			//!< Entries keyed by IMSI and version.
+	sigtran_vector_entry_t	*head;			//!< Entry which expires first.
+	sigtran_vector_entry_t	*tail;			//!< Entry which expires last.
+
+	unsigned int		refills;		//!< Outstanding refill transactions.
+};
+
+static int sigtran_vector_entry_cmp(void const *a, void const *b)
+{
+	sigtran_vector_entry_t const	*a_entry = a;	/* May be stack allocated */
+	sigtran_vector_entry_t const	*b_entry = b;	/* May be stack allocated */
+	size_t				a_len = talloc_array_length(a_entry->imsi);
+	size_t				b_len = talloc_array_length(b_entry->imsi);
+	int				ret;
+
+	if (a_entry->version > b_entry->version) return +1;
+	if (a_entry->version < b_entry->version) return -1;
+
+	if (a_len > b_len) return +1;
+	if (a_len < b_len) return -1;
+
+	ret = memcmp(a_entry->imsi, b_entry->imsi, a_len);
+	if (ret > 0) return +1;
+	if (ret < 0) return -1;
+
+	return 0;
+}
+
+/** Remove an entry from the expiry list
+ *
+ */
+static void entry_unlink(sigtran_vector_cache_t *cache, sigtran_vector_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+}
+
+/** Remove an entry from the cache and free it, along with any vectors it holds
+ *
+ */
+static void entry_free(sigtran_vector_cache_t *cache, sigtran_vector_entry_t *entry)
+{
+	rad_assert(!entry->refilling);
+
+	entry_unlink(cache, entry);
+	rbtree_deletebydata(cache->tree, entry);
+	talloc_free(entry);
+}
+
+/** Discard entries whose vectors are too old to use
+ *
+ * Entries with an outstanding refill are left alone, the refill's
+ * completion callback still needs them.
+ */
+static void entry_expire(sigtran_vector_cache_t *cache, time_t now)
+{
+	sigtran_vector_entry_t *entry, *next;
+
+	for (entry = cache->head; entry && (entry->expires <= now); entry = next) {
+		next = entry->next;
+
+		if (entry->refilling) continue;
+
+		DEBUG3("Discarding %u expired vector(s)", entry->count);
+		entry_free(cache, entry);
+	}
+}
+
+/** Find or create the entry for an IMSI
+ *
+ * If the cache is full the entry closest to expiry is evicted to make room.
+ *
+ * @return
+ *	- The entry.
+ *	- NULL if the cache is full, and every entry has a refill outstanding.
+ */
+static sigtran_vector_entry_t *entry_find_or_alloc(sigtran_vector_cache_t *cache,
+						   uint8_t const *imsi, uint8_t version)
+{
+	sigtran_vector_entry_t	find, *entry;
+
+	memcpy(&find.imsi, &imsi, sizeof(find.imsi));
+	find.version = version;
+
+	entry = rbtree_finddata(cache->tree, &find);
+	if (entry) return entry;
+
+	if (rbtree_num_elements(cache->tree) >= cache->conf->max_entries) {
+		for (entry = cache->head; entry && entry->refilling; entry = entry->next);
+		if (!entry) return NULL;
+
+		entry_free(cache, entry);
+	}
+
+	MEM(entry = talloc_zero(cache, sigtran_vector_entry_t));
+	entry->cache = cache;
+	entry->imsi = talloc_memdup(entry, imsi, talloc_array_length(imsi));
+	entry->version = version;
+	entry->tail = &entry->head;
+
+	if (!rbtree_insert(cache->tree, entry)) {
+		talloc_free(entry);
+		return NULL;
+	}
+
+	/*
+	 *	entry_add() moves it to the correct
+	 *	position once it has vectors.
+	 */
+	entry->next = cache->head;
+	if (cache->head) {
+		cache->head->prev = entry;
+	} else {
+		cache->tail = entry;
+	}
+	cache->head = entry;
+
+	return entry;
+}
+
+/** Add vectors to an entry, taking ownership of them
+ *
+ */
+static void entry_add(sigtran_vector_cache_t *cache, sigtran_vector_entry_t *entry, sigtran_vector_t *vector)
+{
+	sigtran_vector_t *vec, *next;
+
+	for (vec = vector; vec; vec = next) {
+		next = vec->next;
+
+		vec->next = NULL;
+		talloc_steal(entry, vec);
+		*entry->tail = vec;
+		entry->tail = &vec->next;
+		entry->count++;
+	}
+
+	/*
+	 *	Vectors are fresh, move the entry to the end of the expiry list
+	 */
+	entry->expires = time(NULL) + cache->conf->lifetime;
+	entry_unlink(cache, entry);
+	entry->prev = cache->tail;
+	if (cache->tail) {
+		cache->tail->next = entry;
+	} else {
+		cache->head = entry;
+	}
+	cache->tail = entry;
+}
+
+/** Record that a refill has finished
+ *
+ * @note Must be called with the cache mutex held.
+ */
+static void refill_done(sigtran_vector_cache_t *cache, sigtran_vector_entry_t *entry)
+{
+	entry->refilling = false;
+	if (--cache->refills == 0) pthread_cond_broadcast(&cache->refilled);
+}
+
+/** Store the vectors from a refill transaction
+ *
+ * Called by the event loop, so must not log against a request.
+ */
+static void _vector_refill_complete(sigtran_transaction_t *txn)
+{
+	sigtran_vector_entry_t	*entry = talloc_get_type_abort(txn->ctx.uctx, sigtran_vector_entry_t);
+	sigtran_vector_cache_t	*cache = entry->cache;
+
+	pthread_mutex_lock(&cache->mutex);
+	if (txn->response.type == SIGTRAN_RESPONSE_OK) {
+		sigtran_map_send_auth_info_res_t *res = talloc_get_type_abort(txn->response.data,
+									      sigtran_map_send_auth_info_res_t);
+
+		entry_add(cache, entry, res->vector);
+		res->vector = NULL;
+		DEBUG3("Refilled vectors, %u now cached for IMSI", entry->count);
+	} else {
+		DEBUG2("Failed refilling vectors");
+	}
+	refill_done(cache, entry);
+	pthread_mutex_unlock(&cache->mutex);
+
+	talloc_free(txn);
+}
+
+/** Queue a transaction to refill an entry, without waiting for the result
+ *
+ */
+static void vector_refill(sigtran_vector_cache_t *cache, sigtran_vector_entry_t *entry, REQUEST *request)
+{
+	sigtran_transaction_t			*txn;
+	sigtran_map_send_auth_info_req_t	*req;
+
+	MEM(txn = talloc_zero(NULL, sigtran_transaction_t));
+	txn->request.type = SIGTRAN_REQUEST_MAP_SEND_AUTH_INFO;
+	txn->ctx.complete = _vector_refill_complete;
+	txn->ctx.uctx = entry;
+
+	MEM(req = talloc_zero(txn, sigtran_map_send_auth_info_req_t));
+	req->conn = cache->conn;
+	req->imsi = talloc_memdup(req, entry->imsi, talloc_array_length(entry->imsi));	/* Entry can't be freed */
+	req->version = entry->version;
+	req->num_vectors = cache->conf->num_vectors;
+	txn->request.data = req;
+
+	RDEBUG2("Requesting %u more vector(s) from HLR", req->num_vectors);
+
+	if (sigtran_event_enqueue(txn) < 0) {
+		RWDEBUG("Failed queuing vector refill");
+
+		pthread_mutex_lock(&cache->mutex);
+		refill_done(cache, entry);
+		pthread_mutex_unlock(&cache->mutex);
+
+		talloc_free(txn);
+	}
+}
+
+/** Return the number of vectors needed for one authentication
+ *
+ * MAP v2 returns GSM triplets, of which EAP-SIM uses three.  MAP v3 returns
+ * UMTS quintuplets, of which EAP-AKA uses one.
+ */
+unsigned int sigtran_vector_per_auth(uint8_t version)
+{
+	return (version == 2) ? 3 : 1;
+}
+
+/** Take enough vectors for one authentication from the cache
+ *
+ * If the number of vectors remaining falls below the refill threshold
+ * a refill transaction is queued.
+ *
+ * @param[in] ctx	to steal the vectors into.
+ * @param[out] out	Where to write the list of vectors.
+ * @param[in] cache	to take the vectors from.
+ * @param[in] request	The current request.
+ * @param[in] imsi	BCD encoded IMSI.
+ * @param[in] version	of MAP the vectors are needed for.
+ * @return
+ *	- The number of vectors written to out.
+ *	- 0 if there weren't enough cached vectors.
+ */
+unsigned int sigtran_vector_cache_get(TALLOC_CTX *ctx, sigtran_vector_t **out, sigtran_vector_cache_t *cache,
+				      REQUEST *request, uint8_t const *imsi, uint8_t version)
+{
+	sigtran_vector_entry_t	find, *entry;
+	sigtran_vector_t	*vec, **last = out;
+	unsigned int		needed = sigtran_vector_per_auth(version), remaining, i;
+	bool			refill = false;
+
+	*out = NULL;
+
+	memcpy(&find.imsi, &imsi, sizeof(find.imsi));
+	find.version = version;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry_expire(cache, time(NULL));
+
+	entry = rbtree_finddata(cache->tree, &find);
+	if (!entry || (entry->count < needed)) {
+		pthread_mutex_unlock(&cache->mutex);
+		RDEBUG2("Vector cache miss");
+		return 0;
+	}
+
+	for (i = 0; i < needed; i++) {
+		vec = entry->head;
+		entry->head = vec->next;
+		vec->next = NULL;
+
+		talloc_steal(ctx, vec);
+		*last = vec;
+		last = &vec->next;
+	}
+	remaining = entry->count -= needed;
+	if (!entry->head) entry->tail = &entry->head;
+
+	if ((entry->count < cache->conf->refill_threshold) && !entry->refilling) {
+		entry->refilling = true;
+		cache->refills++;
+		refill = true;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	RDEBUG2("Vector cache hit, %u vector(s) remaining", remaining);
+
+	if (refill) vector_refill(cache, entry, request);
+
+	return needed;
+}
+
+/** Store vectors which weren't needed for the current authentication
+ *
+ * @param[in] cache	to add the vectors to.
+ * @param[in] imsi	BCD encoded IMSI.
+ * @param[in] version	of MAP the vectors were retrieved with.
+ * @param[in] vector	List of vectors.  Ownership passes to the cache, unless
+ *			the cache is full.
+ */
+void sigtran_vector_cache_add(sigtran_vector_cache_t *cache, uint8_t const *imsi, uint8_t version,
+			      sigtran_vector_t *vector)
+{
+	sigtran_vector_entry_t *entry;
+
+	if (!vector) return;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry_expire(cache, time(NULL));
+
+	entry = entry_find_or_alloc(cache, imsi, version);
+	if (!entry) {
+		pthread_mutex_unlock(&cache->mutex);
+		DEBUG3("Vector cache full, discarding vectors");
+		return;
+	}
+	entry_add(cache, entry, vector);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+static int _vector_cache_free(sigtran_vector_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+	pthread_cond_destroy(&cache->refilled);
+
+	return 0;
+}
+
+/** Allocate a new vector cache
+ *
+ * @param[in] ctx	to allocate the cache in.
+ * @param[in] conf	for the cache.  Must remain valid for the lifetime of the cache.
+ * @param[in] conn	to send refill transactions on.
+ * @return
+ *	- A new vector cache.
+ *	- NULL on error.
+ */
+sigtran_vector_cache_t *sigtran_vector_cache_alloc(TALLOC_CTX *ctx, sigtran_vector_cache_conf_t const *conf,
+						   sigtran_conn_t const *conn)
+{
+	sigtran_vector_cache_t *cache;
+
+	MEM(cache = talloc_zero(ctx, sigtran_vector_cache_t));
+	cache->conf = conf;
+	cache->conn = conn;
+
+	cache->tree = rbtree_create(cache, sigtran_vector_entry_cmp, NULL, 0);
+	if (!cache->tree) {
+		talloc_free(cache);
+		return NULL;
+	}
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	pthread_cond_init(&cache->refilled, NULL);
+	talloc_set_destructor(cache, _vector_cache_free);
+
+	return cache;
+}
+
+/** Free a vector cache, once all of its refills have completed
+ *
+ * Refills are bounded by the TCAP timeout, so this doesn't block for long.
+ */
+void sigtran_vector_cache_free(sigtran_vector_cache_t *cache)
+{
+	if (!cache) return;
+
+	pthread_mutex_lock(&cache->mutex);
+	while (cache->refills > 0) pthread_cond_wait(&cache->refilled, &cache->mutex);
+	pthread_mutex_unlock(&cache->mutex);
+
+	talloc_free(cache);
+}
@@ -0,0 +1,429 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file batch.c
+ * @brief Write the queries of many requests in one transaction.
+ *
+ * Requests are queued per thread, and yield until their batch has
+ * been committed.  Each request's queries run inside a savepoint,
+ * so a failed query only rolls back that request's changes, and
+ * the next query in its redundant set can be tried, as it would be
+ * without batching.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_sql (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "rlm_sql.h"
+
+typedef struct sql_batch_entry sql_batch_entry_t;
+
+/** A request waiting for its batch to be written
+ *
+ */
+struct sql_batch_entry {
+	sql_batch_t		*batch;		//!< The request was queued in.
+	REQUEST			*request;	//!< The queries are for.
+	CONF_PAIR		*pair;		//!< First query to try.
+	char const		*attr;		//!< Name of the set of redundant queries.
+
+	bool			queued;		//!< Whether the entry is still in the queue.
+	rlm_rcode_t		rcode;		//!< Result, once the batch has been written.
+
+	sql_batch_entry_t	*next;		//!< Next entry in the queue.
+};
+
+/** Requests from one thread, using one accounting section
+ *
+ */
+struct sql_batch {
+	rlm_sql_t const		*inst;		//!< Module instance.
+	sql_acct_section_t	*section;	//!< The queries come from.
+	fr_event_list_t		*el;		//!< To insert the flush timer in.
+
+	sql_batch_entry_t	*head;		//!< Oldest queued entry.
+	sql_batch_entry_t	**tail;		//!< Where to add the next entry.
+	uint32_t		count;		//!< Number of entries in the queue.
+
+	fr_event_timer_t const	*ev;		//!< When the oldest entry has waited long enough.
+};
+
+#define BATCH_SAVEPOINT		"SAVEPOINT fr_batch"
+#define BATCH_RELEASE		"RELEASE SAVEPOINT fr_batch"
+#define BATCH_ROLLBACK		"ROLLBACK TO SAVEPOINT fr_batch"
+
+/** Execute a statement which controls the transaction
+ *
+ */
+static bool batch_statement(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, char const *stmt)
+{
+	if (rlm_sql_query_once(inst, request, handle, stmt) != RLM_SQL_OK) {
+		REDEBUG("Failed executing \"%s\"", stmt);
+		return false;
+	}
+	(inst->driver->sql_finish_query)(handle, inst->config);
+
+	return true;
+}
+
+/** Execute the queries for one request
+ *
+ * Follows the same rules as acct_redundant, trying the next query
+ * in the set if a query fails with a constraint violation, or
+ * doesn't update any rows.
+ *
+ * @return
+ *	- true if the transaction can continue.
+ *	- false if the connection failed, or is in an unknown state.
+ */
+static bool batch_entry_execute(sql_batch_t *batch, rlm_sql_handle_t *handle, sql_batch_entry_t *entry)
+{
+	rlm_sql_t const		*inst = batch->inst;
+	REQUEST			*request = entry->request;
+	CONF_PAIR		*pair = entry->pair;
+	char const		*value;
+	sql_stmt_t		*stmt = NULL;
+	sql_rcode_t		sql_ret;
+	int			numaffected;
+
+	while (true) {
+		value = cf_pair_value(pair);
+		if (!value) {
+			RDEBUG("Ignoring null query");
+			entry->rcode = RLM_MODULE_NOOP;
+			return true;
+		}
+
+		if (sql_stmt_aeval(request, &stmt, inst, request, handle, value) < 0) {
+			entry->rcode = RLM_MODULE_FAIL;
+			return true;
+		}
+
+		if (!*stmt->query) {
+			RDEBUG("Ignoring null query");
+			talloc_free(stmt);
+			entry->rcode = RLM_MODULE_NOOP;
+			return true;
+		}
+
+		rlm_sql_query_log(inst, request, batch->section, stmt->query);
+
+		if (!batch_statement(inst, request, handle, BATCH_SAVEPOINT)) {
+			talloc_free(stmt);
+			entry->rcode = RLM_MODULE_FAIL;
+			return false;
+		}
+
+		sql_ret = rlm_sql_query_stmt_once(inst, request, handle, stmt);
+		TALLOC_FREE(stmt);
+		RDEBUG("SQL query returned: %s", fr_int2str(sql_rcode_table, sql_ret, "<INVALID>"));
+
+		switch (sql_ret) {
+		case RLM_SQL_OK:
+			numaffected = (inst->driver->sql_affected_rows)(handle, inst->config);
+			(inst->driver->sql_finish_query)(handle, inst->config);
+			RDEBUG("%i record(s) updated", numaffected);
+
+			if (!batch_statement(inst, request, handle, BATCH_RELEASE)) {
+				entry->rcode = RLM_MODULE_FAIL;
+				return false;
+			}
+
+			if (numaffected > 0) {
+				entry->rcode = RLM_MODULE_OK;
+				return true;
+			}
+			break;
+
+		/*
+		 *  The connection has gone, and the transaction with it.
+		 */
+		case RLM_SQL_RECONNECT:
+			entry->rcode = RLM_MODULE_FAIL;
+			return false;
+
+		/*
+		 *  Driver found an error (like a unique key constraint violation)
+		 *  that hinted it might be a good idea to try an alternative query.
+		 */
+		case RLM_SQL_ALT_QUERY:
+			if (!batch_statement(inst, request, handle, BATCH_ROLLBACK)) {
+				entry->rcode = RLM_MODULE_FAIL;
+				return false;
+			}
+			break;
+
+		/*
+		 *  Undo anything the query did, and carry on with the
+		 *  queries of the other requests.
+		 */
+		default:
+			entry->rcode = (sql_ret == RLM_SQL_QUERY_INVALID) ? RLM_MODULE_INVALID : RLM_MODULE_FAIL;
+			return batch_statement(inst, request, handle, BATCH_ROLLBACK);
+		}
+
+		/*
+		 *  We assume all entries with the same name form a redundant
+		 *  set of queries.
+		 */
+		pair = cf_pair_find_next(batch->section->cs, pair, entry->attr);
+		if (!pair) {
+			RDEBUG("No additional queries configured");
+			entry->rcode = RLM_MODULE_NOOP;
+			return true;
+		}
+
+		RDEBUG("Trying next query...");
+	}
+}
+
+/** Write all queued queries in one transaction, and resume the requests
+ *
+ * @param[in] batch	to write.
+ * @param[in] current	request, which is running, and so isn't resumed.  May be NULL.
+ */
+static void batch_flush(sql_batch_t *batch, REQUEST *current)
+{
+	rlm_sql_t const		*inst = batch->inst;
+	sql_batch_entry_t	*head, *entry, *next;
+	rlm_sql_handle_t	*handle;
+	REQUEST			*request;
+	uint32_t		count;
+	bool			committed = false;
+
+	head = batch->head;
+	count = batch->count;
+	batch->head = NULL;
+	batch->tail = &batch->head;
+	batch->count = 0;
+	if (batch->ev) (void) fr_event_timer_delete(batch->el, &batch->ev);
+
+	if (!head) return;
+
+	for (entry = head; entry; entry = entry->next) {
+		entry->queued = false;
+		entry->rcode = RLM_MODULE_FAIL;
+	}
+
+	/*
+	 *	The first request is used for logging
+	 *	anything which isn't specific to a request.
+	 */
+	request = head->request;
+
+	RDEBUG2("Writing queries for %u request(s) in one transaction", count);
+
+	handle = fr_pool_connection_get(inst->pool, request);
+	if (!handle) goto finish;
+
+	/*
+	 *	Reconnecting is fine until the transaction
+	 *	has started.
+	 */
+	if (rlm_sql_query(inst, request, &handle, "BEGIN") != RLM_SQL_OK) {
+		REDEBUG("Failed starting transaction");
+		if (handle) fr_pool_connection_release(inst->pool, request, handle);
+		goto finish;
+	}
+	(inst->driver->sql_finish_query)(handle, inst->config);
+
+	for (entry = head; entry; entry = entry->next) {
+		if (!batch_entry_execute(batch, handle, entry)) break;
+	}
+
+	if (!entry) committed = batch_statement(inst, request, handle, "COMMIT");
+
+	/*
+	 *	Closing the connection discards the
+	 *	transaction, whatever state it's in.
+	 */
+	if (!committed) {
+		REDEBUG("Transaction failed, none of the queries in the batch were written");
+		fr_pool_connection_close(inst->pool, request, handle);
+		goto finish;
+	}
+
+	fr_pool_connection_release(inst->pool, request, handle);
+
+finish:
+	for (entry = head; entry; entry = next) {
+		next = entry->next;
+		entry->next = NULL;
+
+		/*
+		 *	Queries which succeeded were rolled back with
+		 *	everything else.
+		 */
+		if (!committed) entry->rcode = RLM_MODULE_FAIL;
+
+		if (entry->request != current) unlang_resumable(entry->request);
+	}
+}
+
+static void _batch_timeout(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	batch_flush(talloc_get_type_abort(uctx, sql_batch_t), NULL);
+}
+
+/** Return the result of the request's queries
+ *
+ */
+static rlm_rcode_t mod_batch_resume(REQUEST *request, void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_sql_t const		*inst = instance;
+	sql_batch_entry_t	*entry = talloc_get_type_abort(ctx, sql_batch_entry_t);
+	rlm_rcode_t		rcode = entry->rcode;
+
+	talloc_free(entry);
+	sql_unset_user(inst, request);
+
+	return rcode;
+}
+
+/** Remove the request from the queue if it's stopped
+ *
+ */
+static void mod_batch_signal(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+			     fr_state_action_t action)
+{
+	sql_batch_entry_t	*entry = talloc_get_type_abort(ctx, sql_batch_entry_t);
+	sql_batch_t		*batch = entry->batch;
+	sql_batch_entry_t	**last;
+
+	if (action != FR_ACTION_DONE) return;
+
+	if (entry->queued) {
+		for (last = &batch->head; *last; last = &(*last)->next) {
+			if (*last != entry) continue;
+
+			*last = entry->next;
+			if (batch->tail == &entry->next) batch->tail = last;
+			break;
+		}
+
+		if (--batch->count == 0) (void) fr_event_timer_delete(batch->el, &batch->ev);
+	}
+
+	talloc_free(entry);
+}
+
+/** Queue a request's queries, to be written with those of other requests
+ *
+ * The caller must already have called sql_set_user.
+ *
+ * @param[in] batch	to add the request to.
+ * @param[in] request	the queries are for.
+ * @param[in] pair	first query to try.
+ * @param[in] attr	name of the set of redundant queries.
+ * @return
+ *	- #RLM_MODULE_YIELD if the request is waiting for the batch to be written.
+ *	- The result of the queries, if the request filled the batch.
+ */
+rlm_rcode_t sql_batch_add(sql_batch_t *batch, REQUEST *request, CONF_PAIR *pair, char const *attr)
+{
+	rlm_sql_t const		*inst = batch->inst;
+	sql_batch_entry_t	*entry;
+	rlm_rcode_t		rcode;
+	struct timeval		now, when;
+
+	MEM(entry = talloc_zero(request, sql_batch_entry_t));
+	entry->batch = batch;
+	entry->request = request;
+	entry->pair = pair;
+	entry->attr = attr;
+	entry->queued = true;
+
+	*batch->tail = entry;
+	batch->tail = &entry->next;
+	batch->count++;
+
+	if (batch->count >= batch->section->batch_size) {
+		batch_flush(batch, request);
+
+		rcode = entry->rcode;
+		talloc_free(entry);
+		sql_unset_user(inst, request);
+
+		return rcode;
+	}
+
+	if (!batch->ev) {
+		gettimeofday(&now, NULL);
+		fr_timeval_add(&when, &now, &batch->section->batch_timeout);
+
+		if (fr_event_timer_insert(batch, batch->el, &batch->ev, &when, _batch_timeout, batch) < 0) {
+			RPEDEBUG("Failed inserting batch timer");
+			batch_flush(batch, request);
+
+			rcode = entry->rcode;
+			talloc_free(entry);
+			sql_unset_user(inst, request);
+
+			return rcode;
+		}
+	}
+
+	RDEBUG2("Waiting for batch to be written, %u request(s) queued", batch->count);
+
+	return unlang_module_yield(request, mod_batch_resume, mod_batch_signal, entry);
+}
+
+static int _batch_free(sql_batch_t *batch)
+{
+	sql_batch_entry_t *entry;
+
+	if (batch->ev) (void) fr_event_timer_delete(batch->el, &batch->ev);
+
+	/*
+	 *	The requests are being freed too.
+	 */
+	for (entry = batch->head; entry; entry = entry->next) entry->queued = false;
+
+	return 0;
+}
+
+/** Allocate a queue for one thread, and one accounting section
+ *
+ * @param[in] ctx	to allocate the queue in.
+ * @param[in] inst	of rlm_sql.
+ * @param[in] section	the queries come from.
+ * @param[in] el	the thread services.
+ * @return the new queue.
+ */
+sql_batch_t *sql_batch_alloc(TALLOC_CTX *ctx, rlm_sql_t const *inst, sql_acct_section_t *section,
+			     fr_event_list_t *el)
+{
+	sql_batch_t *batch;
+
+	MEM(batch = talloc_zero(ctx, sql_batch_t));
+	batch->inst = inst;
+	batch->section = section;
+	batch->el = el;
+	batch->tail = &batch->head;
+	talloc_set_destructor(batch, _batch_free);
+
+	return batch;
+}
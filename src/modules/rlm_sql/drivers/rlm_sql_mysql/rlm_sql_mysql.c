@@ -49,6 +49,15 @@ RCSID("$Id$")
 
 #include "rlm_sql.h"
 
+/*
+ *	MariaDB's client library provides a non-blocking API, which
+ *	lets rlm_sql yield whilst waiting for the results of queries.
+ */
+#ifdef MYSQL_WAIT_READ
+#  include <poll.h>
+#  define HAVE_MYSQL_NONBLOCK 1
+#endif
+
 typedef enum {
 	SERVER_WARNINGS_AUTO = 0,
 	SERVER_WARNINGS_YES,
@@ -66,8 +75,32 @@ typedef struct rlm_sql_mysql_conn {
 	MYSQL		db;
 	MYSQL		*sock;
 	MYSQL_RES	*result;
+	fr_value_box_t	*boxes;		//!< Fields of the current row, see sql_fetch_row_boxed.
+#ifdef HAVE_MYSQL_NONBLOCK
+	int		async_status;	//!< What the pending query is waiting for, 0 if complete.
+	int		async_err;	//!< Returned by the query once complete.
+#endif
+#if (MYSQL_VERSION_ID >= 40100)
+	rbtree_t	*statements;	//!< Prepared on this connection, keyed by query.
+	MYSQL_STMT	*stmt;		//!< Prepared statement executed by the current query.
+#endif
 } rlm_sql_mysql_conn_t;
 
+#if (MYSQL_VERSION_ID >= 40100)
+/** A statement prepared on a connection
+ *
+ */
+typedef struct {
+	char const	*query;		//!< The statement was prepared from.
+	MYSQL_STMT	*stmt;
+} rlm_sql_mysql_stmt_t;
+
+/*
+ *	Forget every prepared statement if there are more than this.
+ */
+#  define MYSQL_MAX_STATEMENTS	256
+#endif
+
 typedef struct rlm_sql_mysql_config {
 	char const *tls_ca_file;		//!< Path to the CA used to validate the server's certificate.
 	char const *tls_ca_path;		//!< Directory containing CAs that may be used to validate the
@@ -108,6 +141,14 @@ static int _sql_socket_destructor(rlm_sql_mysql_conn_t *conn)
 {
 	DEBUG2("Socket destructor called, closing socket");
 
+#if (MYSQL_VERSION_ID >= 40100)
+	/*
+	 *	Statements must be closed while
+	 *	the connection is still open.
+	 */
+	TALLOC_FREE(conn->statements);
+#endif
+
 	if (conn->sock){
 		mysql_close(conn->sock);
 	}
@@ -187,6 +228,13 @@ static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *c
 	}
 #endif
 
+#ifdef HAVE_MYSQL_NONBLOCK
+	/*
+	 *	Blocking calls still work on the connection.
+	 */
+	mysql_options(&(conn->db), MYSQL_OPT_NONBLOCK, 0);
+#endif
+
 #if (MYSQL_VERSION_ID >= 50000)
 	mysql_options(&(conn->db), MYSQL_OPT_CONNECT_TIMEOUT, &connect_timeout);
 
@@ -344,6 +392,189 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 	return RLM_SQL_OK;
 }
 
+#ifdef HAVE_MYSQL_NONBLOCK
+/** Continue the pending query until it's complete, or needs to read from the server
+ *
+ * Writes are rare once the query has been sent, and are
+ * waited for here.
+ */
+static void sql_query_continue(rlm_sql_mysql_conn_t *conn, int ready)
+{
+	struct pollfd fds;
+
+	conn->async_status = mysql_real_query_cont(&conn->async_err, conn->sock, ready);
+
+	while (conn->async_status & MYSQL_WAIT_WRITE) {
+		fds.fd = mysql_get_socket(conn->sock);
+		fds.events = POLLOUT;
+		fds.revents = 0;
+
+		if ((poll(&fds, 1, -1) < 0) && (errno != EINTR)) break;
+
+		conn->async_status = mysql_real_query_cont(&conn->async_err, conn->sock, MYSQL_WAIT_WRITE);
+	}
+}
+
+/** Convert the result of a completed query into an sql_rcode_t
+ *
+ */
+static sql_rcode_t sql_query_async_done(rlm_sql_mysql_conn_t *conn)
+{
+	sql_rcode_t rcode;
+	char const *info;
+
+	rcode = sql_check_error(conn->sock, 0);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	/* Only returns non-null string for INSERTS */
+	info = mysql_info(conn->sock);
+	if (info) DEBUG2("%s", info);
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_query_async(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config, char const *query)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+
+	if (!conn->sock) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	conn->async_status = mysql_real_query_start(&conn->async_err, conn->sock, query, strlen(query));
+	if (conn->async_status & MYSQL_WAIT_WRITE) sql_query_continue(conn, 0);
+
+	/*
+	 *	Errors sending the query are picked
+	 *	up by sql_query_async_result.
+	 */
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_query_async_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+
+	if (conn->async_status & MYSQL_WAIT_READ) sql_query_continue(conn, MYSQL_WAIT_READ);
+	if (conn->async_status) return RLM_SQL_YIELD;
+
+	return sql_query_async_done(conn);
+}
+
+static int sql_fd(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+
+	if (!conn->sock) return -1;
+
+	return mysql_get_socket(conn->sock);
+}
+#endif
+
+#if (MYSQL_VERSION_ID >= 40100)
+static int sql_stmt_cmp(void const *one, void const *two)
+{
+	rlm_sql_mysql_stmt_t const *a = one, *b = two;
+
+	return strcmp(a->query, b->query);
+}
+
+static void _sql_stmt_free(void *data)
+{
+	rlm_sql_mysql_stmt_t *stmt = data;
+
+	mysql_stmt_close(stmt->stmt);
+}
+
+/** Execute a query with placeholders, preparing it if it hasn't been prepared on this connection
+ *
+ */
+static sql_rcode_t sql_query_prepared(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config, char const *query,
+				      sql_param_t const *params, int num_params)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	rlm_sql_mysql_stmt_t	find, *stmt;
+	MYSQL_BIND		*bind;
+	struct {
+		long long	integer;
+		double		real;
+		unsigned long	length;
+	}			*values;
+	sql_rcode_t		rcode;
+	int			i;
+
+	if (!conn->sock) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!conn->statements) {
+		MEM(conn->statements = rbtree_create(conn, sql_stmt_cmp, _sql_stmt_free, RBTREE_FLAG_NONE));
+	}
+
+	find.query = query;
+	stmt = rbtree_finddata(conn->statements, &find);
+	if (!stmt) {
+		MYSQL_STMT *mstmt;
+
+		if (rbtree_num_elements(conn->statements) >= MYSQL_MAX_STATEMENTS) {
+			DEBUG("Too many prepared statements, closing them all");
+
+			talloc_free(conn->statements);
+			MEM(conn->statements = rbtree_create(conn, sql_stmt_cmp, _sql_stmt_free, RBTREE_FLAG_NONE));
+		}
+
+		mstmt = mysql_stmt_init(conn->sock);
+		if (!mstmt) return sql_check_error(conn->sock, 0);
+
+		if (mysql_stmt_prepare(mstmt, query, strlen(query)) != 0) {
+			ERROR("Failed preparing statement: %s", mysql_stmt_error(mstmt));
+			rcode = sql_check_error(NULL, mysql_stmt_errno(mstmt));
+			mysql_stmt_close(mstmt);
+			return rcode;
+		}
+
+		MEM(stmt = talloc_zero(conn->statements, rlm_sql_mysql_stmt_t));
+		stmt->query = talloc_typed_strdup(stmt, query);
+		stmt->stmt = mstmt;
+
+		rbtree_insert(conn->statements, stmt);
+	}
+
+	conn->stmt = stmt->stmt;
+
+	MEM(bind = talloc_zero_array(conn, MYSQL_BIND, num_params ? num_params : 1));
+	MEM(values = talloc_zero_size(bind, sizeof(*values) * (num_params ? num_params : 1)));
+
+	for (i = 0; i < num_params; i++) {
+		if (!params[i].numeric) {
+			bind[i].buffer_type = MYSQL_TYPE_STRING;
+			memcpy(&bind[i].buffer, &params[i].value, sizeof(bind[i].buffer));
+			bind[i].buffer_length = params[i].length;
+			values[i].length = params[i].length;
+			bind[i].length = &values[i].length;
+		} else if (strchr(params[i].value, '.')) {
+			values[i].real = strtod(params[i].value, NULL);
+			bind[i].buffer_type = MYSQL_TYPE_DOUBLE;
+			bind[i].buffer = &values[i].real;
+		} else {
+			values[i].integer = strtoll(params[i].value, NULL, 10);
+			bind[i].buffer_type = MYSQL_TYPE_LONGLONG;
+			bind[i].buffer = &values[i].integer;
+		}
+	}
+
+	if (mysql_stmt_bind_param(stmt->stmt, bind) || mysql_stmt_execute(stmt->stmt)) {
+		talloc_free(bind);
+		return sql_check_error(NULL, mysql_stmt_errno(stmt->stmt));
+	}
+	talloc_free(bind);
+
+	return RLM_SQL_OK;
+}
+#endif
+
 static sql_rcode_t sql_store_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
@@ -457,24 +688,22 @@ static sql_rcode_t sql_fields(char const **out[], rlm_sql_handle_t *handle, rlm_
 	return RLM_SQL_OK;
 }
 
-static sql_rcode_t sql_fetch_row(rlm_sql_row_t *out, rlm_sql_handle_t *handle, rlm_sql_config_t *config)
+/** Fetch the next row from the current, or the next result set
+ *
+ */
+static sql_rcode_t sql_fetch_mysql_row(MYSQL_ROW *out, unsigned int *num_fields, unsigned long **field_lens,
+				       rlm_sql_handle_t *handle, rlm_sql_config_t *config)
 {
 	rlm_sql_mysql_conn_t	*conn = handle->conn;
 	sql_rcode_t		rcode;
 	MYSQL_ROW		row;
 	int			ret;
-	unsigned int		num_fields, i;
-	unsigned long		*field_lens;
-
-	*out = NULL;
 
 	/*
 	 *  Check pointer before de-referencing it.
 	 */
 	if (!conn->result) return RLM_SQL_RECONNECT;
 
-	TALLOC_FREE(handle->row);		/* Clear previous row set */
-
 retry_fetch_row:
 	row = mysql_fetch_row(conn->result);
 	if (!row) {
@@ -496,10 +725,28 @@ retry_fetch_row:
 		return RLM_SQL_NO_MORE_ROWS;
 	}
 
-	num_fields = mysql_num_fields(conn->result);
-	if (!num_fields) return RLM_SQL_NO_MORE_ROWS;
+	*num_fields = mysql_num_fields(conn->result);
+	if (!*num_fields) return RLM_SQL_NO_MORE_ROWS;
+
+ 	*field_lens = mysql_fetch_lengths(conn->result);
+	*out = row;
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_fetch_row(rlm_sql_row_t *out, rlm_sql_handle_t *handle, rlm_sql_config_t *config)
+{
+	sql_rcode_t		rcode;
+	MYSQL_ROW		row;
+	unsigned int		num_fields, i;
+	unsigned long		*field_lens;
+
+	*out = NULL;
+
+	TALLOC_FREE(handle->row);		/* Clear previous row set */
 
- 	field_lens = mysql_fetch_lengths(conn->result);
+	rcode = sql_fetch_mysql_row(&row, &num_fields, &field_lens, handle, config);
+	if (rcode != RLM_SQL_OK) return rcode;
 
 	MEM(*out = handle->row = talloc_zero_array(handle, char *, num_fields + 1));
 	for (i = 0; i < num_fields; i++) {
@@ -509,6 +756,45 @@ retry_fetch_row:
 	return RLM_SQL_OK;
 }
 
+/** Fetch the next row, pointing directly at the values in the result
+ *
+ * Values stay valid until the next result set is retrieved, or the result is freed.
+ */
+static sql_rcode_t sql_fetch_row_boxed(fr_value_box_t const **out, rlm_sql_handle_t *handle,
+				       rlm_sql_config_t *config)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	sql_rcode_t		rcode;
+	MYSQL_ROW		row;
+	unsigned int		num_fields, i;
+	unsigned long		*field_lens;
+
+	*out = NULL;
+
+	rcode = sql_fetch_mysql_row(&row, &num_fields, &field_lens, handle, config);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	if (!conn->boxes || (talloc_array_length(conn->boxes) != num_fields)) {
+		talloc_free(conn->boxes);
+		MEM(conn->boxes = talloc_array(conn, fr_value_box_t, num_fields));
+	}
+
+	for (i = 0; i < num_fields; i++) {
+		fr_value_box_t *value = &conn->boxes[i];
+
+		memset(value, 0, sizeof(*value));
+		if (!row[i]) continue;
+
+		value->type = FR_TYPE_STRING;
+		value->vb_strvalue = row[i];
+		value->datum.length = field_lens[i];
+	}
+
+	*out = conn->boxes;
+
+	return RLM_SQL_OK;
+}
+
 static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
@@ -615,14 +901,26 @@ static size_t sql_error(TALLOC_CTX *ctx, sql_log_entry_t out[], size_t outlen,
 	rad_assert(conn && conn->sock);
 	rad_assert(outlen > 0);
 
-	error = mysql_error(conn->sock);
-
+#if (MYSQL_VERSION_ID >= 40100)
 	/*
-	 *	Grab the error now in case it gets cleared on the next operation.
+	 *	Errors from prepared statements are
+	 *	recorded in the statement.
 	 */
-	if (error && (error[0] != '\0')) {
-		error = talloc_asprintf(ctx, "ERROR %u (%s): %s", mysql_errno(conn->sock), error,
-					mysql_sqlstate(conn->sock));
+	if (conn->stmt && mysql_stmt_errno(conn->stmt)) {
+		error = talloc_asprintf(ctx, "ERROR %u (%s): %s", mysql_stmt_errno(conn->stmt),
+					mysql_stmt_error(conn->stmt), mysql_stmt_sqlstate(conn->stmt));
+	} else
+#endif
+	{
+		error = mysql_error(conn->sock);
+
+		/*
+		 *	Grab the error now in case it gets cleared on the next operation.
+		 */
+		if (error && (error[0] != '\0')) {
+			error = talloc_asprintf(ctx, "ERROR %u (%s): %s", mysql_errno(conn->sock), error,
+						mysql_sqlstate(conn->sock));
+		}
 	}
 
 	/*
@@ -681,6 +979,18 @@ static sql_rcode_t sql_finish_query(rlm_sql_handle_t *handle, rlm_sql_config_t *
 	int			ret;
 	MYSQL_RES		*result;
 
+#if (MYSQL_VERSION_ID >= 40100)
+	/*
+	 *	Prepared statements don't return result sets
+	 *	on the connection.
+	 */
+	if (conn->stmt) {
+		mysql_stmt_free_result(conn->stmt);
+		conn->stmt = NULL;
+		return RLM_SQL_OK;
+	}
+#endif
+
 	/*
 	 *	If there's no result associated with the
 	 *	connection handle, assume the first result in the
@@ -724,6 +1034,10 @@ static int sql_affected_rows(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+#if (MYSQL_VERSION_ID >= 40100)
+	if (conn->stmt) return mysql_stmt_affected_rows(conn->stmt);
+#endif
+
 	return mysql_affected_rows(conn->sock);
 }
 
@@ -756,6 +1070,14 @@ rlm_sql_driver_t rlm_sql_mysql = {
 	.mod_instantiate		= mod_instantiate,
 	.sql_socket_init		= sql_socket_init,
 	.sql_query			= sql_query,
+#ifdef HAVE_MYSQL_NONBLOCK
+	.sql_query_async		= sql_query_async,
+	.sql_query_async_result		= sql_query_async_result,
+	.sql_fd				= sql_fd,
+#endif
+#if (MYSQL_VERSION_ID >= 40100)
+	.sql_query_prepared		= sql_query_prepared,
+#endif
 	.sql_select_query		= sql_select_query,
 	.sql_store_result		= sql_store_result,
 	.sql_num_fields			= sql_num_fields,
@@ -763,6 +1085,7 @@ rlm_sql_driver_t rlm_sql_mysql = {
 	.sql_affected_rows		= sql_affected_rows,
 	.sql_fields			= sql_fields,
 	.sql_fetch_row			= sql_fetch_row,
+	.sql_fetch_row_boxed		= sql_fetch_row_boxed,
 	.sql_free_result		= sql_free_result,
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
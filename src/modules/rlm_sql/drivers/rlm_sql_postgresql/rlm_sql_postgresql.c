@@ -59,6 +59,7 @@ RCSID("$Id$")
 
 typedef struct rlm_sql_postgres_config {
 	char const	*db_string;
+	char const	*application_name;	//!< Sent to the server, if send_application_name is set.
 	bool		send_application_name;
 } rlm_sql_postgres_t;
 
@@ -69,8 +70,25 @@ typedef struct rlm_sql_postgres_conn {
 	int		num_fields;
 	int		affected_rows;
 	char		**row;
+	fr_value_box_t	*boxes;			//!< Fields of the current row, see sql_fetch_row_boxed.
+
+	rbtree_t	*statements;		//!< Prepared on this connection, keyed by query.
+	uint32_t	next_statement;		//!< Number used to name the next prepared statement.
 } rlm_sql_postgres_conn_t;
 
+/** A statement prepared on a connection
+ *
+ */
+typedef struct {
+	char const	*query;			//!< The statement was prepared from.
+	char		name[16];		//!< The statement was prepared as.
+} rlm_sql_postgres_stmt_t;
+
+/*
+ *	Forget every prepared statement if there are more than this.
+ */
+#define PG_MAX_STATEMENTS	256
+
 static CONF_PARSER driver_config[] = {
 	{ FR_CONF_OFFSET("send_application_name", FR_TYPE_BOOL, rlm_sql_postgres_t, send_application_name), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
@@ -163,17 +181,98 @@ static int _sql_socket_destructor(rlm_sql_postgres_conn_t *conn)
 	return 0;
 }
 
+/** Build the connection string for a set of connection details
+ *
+ * Replicas have their own server, port, login, password and database,
+ * so this is done for each configuration connections are made with.
+ */
+static char *sql_db_string(TALLOC_CTX *ctx, rlm_sql_postgres_t const *inst, rlm_sql_config_t const *config)
+{
+	char *db_string;
+
+	/*
+	 *	Old style database name
+	 *
+	 *	Append options if they were set in the config
+	 */
+	if (!strchr(config->sql_db, '=')) {
+		db_string = talloc_typed_asprintf(ctx, "dbname='%s'", config->sql_db);
+
+		if (config->sql_server[0] != '\0') {
+			db_string = talloc_asprintf_append(db_string, " host='%s'", config->sql_server);
+		}
+
+		if (config->sql_port) {
+			db_string = talloc_asprintf_append(db_string, " port=%i", config->sql_port);
+		}
+
+		if (config->sql_login[0] != '\0') {
+			db_string = talloc_asprintf_append(db_string, " user='%s'", config->sql_login);
+		}
+
+		if (config->sql_password[0] != '\0') {
+			db_string = talloc_asprintf_append(db_string, " password='%s'", config->sql_password);
+		}
+
+		if (inst->send_application_name) {
+			db_string = talloc_asprintf_append(db_string, " application_name='%s'", inst->application_name);
+		}
+
+	/*
+	 *	New style parameter string
+	 *
+	 *	Only append options when not already present
+	 */
+	} else {
+		db_string = talloc_typed_strdup(ctx, config->sql_db);
+
+		if ((config->sql_server[0] != '\0') && !strstr(db_string, "host=")) {
+			db_string = talloc_asprintf_append(db_string, " host='%s'", config->sql_server);
+		}
+
+		if (config->sql_port && !strstr(db_string, "port=")) {
+			db_string = talloc_asprintf_append(db_string, " port=%i", config->sql_port);
+		}
+
+		if ((config->sql_login[0] != '\0') && !strstr(db_string, "user=")) {
+			db_string = talloc_asprintf_append(db_string, " user='%s'", config->sql_login);
+		}
+
+		if ((config->sql_password[0] != '\0') && !strstr(db_string, "password=")) {
+			db_string = talloc_asprintf_append(db_string, " password='%s'", config->sql_password);
+		}
+
+		if (inst->send_application_name && !strstr(db_string, "application_name=")) {
+			db_string = talloc_asprintf_append(db_string, " application_name='%s'", inst->application_name);
+		}
+	}
+
+	return db_string;
+}
+
 static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
 					    UNUSED struct timeval const *timeout)
 {
 	rlm_sql_postgres_t *inst = config->driver;
 	rlm_sql_postgres_conn_t *conn;
+	char const *db_string;
+	char *db_string_buff = NULL;
 
 	MEM(conn = handle->conn = talloc_zero(handle, rlm_sql_postgres_conn_t));
 	talloc_set_destructor(conn, _sql_socket_destructor);
 
-	DEBUG2("Connecting using parameters: %s", inst->db_string);
-	conn->db = PQconnectdb(inst->db_string);
+	/*
+	 *	Replicas have their own connection details.
+	 */
+	if (!handle->replica) {
+		db_string = inst->db_string;
+	} else {
+		db_string = db_string_buff = sql_db_string(conn, inst, config);
+	}
+
+	DEBUG2("Connecting using parameters: %s", db_string);
+	conn->db = PQconnectdb(db_string);
+	talloc_free(db_string_buff);
 	if (!conn->db) {
 		ERROR("Connection failed: Out of memory");
 		return -1;
@@ -192,38 +291,14 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 	return 0;
 }
 
-static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
-					      char const *query)
+/** Convert the status of the current result into an sql_rcode_t
+ *
+ */
+static sql_rcode_t sql_result_status(rlm_sql_postgres_conn_t *conn)
 {
-	rlm_sql_postgres_conn_t *conn = handle->conn;
 	ExecStatusType status;
 	int numfields = 0;
 
-	if (!conn->db) {
-		ERROR("Socket not connected");
-		return RLM_SQL_RECONNECT;
-	}
-
-	/*
-	 *  Returns a PGresult pointer or possibly a null pointer.
-	 *  A non-null pointer will generally be returned except in
-	 *  out-of-memory conditions or serious errors such as inability
-	 *  to send the command to the server. If a null pointer is
-	 *  returned, it should be treated like a PGRES_FATAL_ERROR
-	 *  result.
-	 */
-	conn->result = PQexec(conn->db, query);
-
-	/*
-	 *  As this error COULD be a connection error OR an out-of-memory
-	 *  condition return value WILL be wrong SOME of the time
-	 *  regardless! Pick your poison...
-	 */
-	if (!conn->result) {
-		ERROR("Failed getting query result: %s", PQerrorMessage(conn->db));
-		return RLM_SQL_RECONNECT;
-	}
-
 	status = PQresultStatus(conn->result);
 	DEBUG("Status: %s", PQresStatus(status));
 
@@ -283,6 +358,190 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED r
 	return RLM_SQL_ERROR;
 }
 
+static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+					      char const *query)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *  Returns a PGresult pointer or possibly a null pointer.
+	 *  A non-null pointer will generally be returned except in
+	 *  out-of-memory conditions or serious errors such as inability
+	 *  to send the command to the server. If a null pointer is
+	 *  returned, it should be treated like a PGRES_FATAL_ERROR
+	 *  result.
+	 */
+	conn->result = PQexec(conn->db, query);
+
+	/*
+	 *  As this error COULD be a connection error OR an out-of-memory
+	 *  condition return value WILL be wrong SOME of the time
+	 *  regardless! Pick your poison...
+	 */
+	if (!conn->result) {
+		ERROR("Failed getting query result: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	return sql_result_status(conn);
+}
+
+/** Send a query without waiting for the result
+ *
+ * The socket is left in blocking mode, so PQsendQuery may block
+ * if the query doesn't fit in the socket's send buffer.  That's
+ * not an issue for the queries rlm_sql generates.
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_query_async(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+						    char const *query)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!PQsendQuery(conn->db, query)) {
+		ERROR("Failed sending query: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	return RLM_SQL_OK;
+}
+
+/** Read whatever data is available for the query sent with sql_query_async
+ *
+ * Each query may produce multiple results.  Like PQexec, we keep the
+ * last one.
+ */
+static sql_rcode_t sql_query_async_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	PGresult *result;
+
+	while (true) {
+		if (!PQconsumeInput(conn->db)) {
+			ERROR("Failed reading query result: %s", PQerrorMessage(conn->db));
+			return RLM_SQL_RECONNECT;
+		}
+
+		/*
+		 *  PQgetResult would block.
+		 */
+		if (PQisBusy(conn->db)) return RLM_SQL_YIELD;
+
+		result = PQgetResult(conn->db);
+		if (!result) break;
+
+		if (conn->result) PQclear(conn->result);
+		conn->result = result;
+	}
+
+	if (!conn->result) {
+		ERROR("Failed getting query result: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	return sql_result_status(conn);
+}
+
+static int sql_stmt_cmp(void const *one, void const *two)
+{
+	rlm_sql_postgres_stmt_t const *a = one, *b = two;
+
+	return strcmp(a->query, b->query);
+}
+
+/** Execute a query with placeholders, preparing it if it hasn't been prepared on this connection
+ *
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_query_prepared(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+						       char const *query, sql_param_t const *params, int num_params)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	rlm_sql_postgres_stmt_t find, *stmt;
+	char const **values;
+	sql_rcode_t rcode;
+	int i;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!conn->statements) {
+		MEM(conn->statements = rbtree_create(conn, sql_stmt_cmp, NULL, RBTREE_FLAG_NONE));
+	}
+
+	find.query = query;
+	stmt = rbtree_finddata(conn->statements, &find);
+	if (!stmt) {
+		if (rbtree_num_elements(conn->statements) >= PG_MAX_STATEMENTS) {
+			DEBUG("Too many prepared statements, deallocating them all");
+
+			PQclear(PQexec(conn->db, "DEALLOCATE ALL"));
+			talloc_free(conn->statements);
+			MEM(conn->statements = rbtree_create(conn, sql_stmt_cmp, NULL, RBTREE_FLAG_NONE));
+		}
+
+		MEM(stmt = talloc_zero(conn->statements, rlm_sql_postgres_stmt_t));
+		stmt->query = talloc_typed_strdup(stmt, query);
+		snprintf(stmt->name, sizeof(stmt->name), "fr_%u", conn->next_statement++);
+
+		/*
+		 *  Parameter types are inferred by the server.
+		 */
+		conn->result = PQprepare(conn->db, stmt->name, query, num_params, NULL);
+		if (!conn->result) {
+			ERROR("Failed preparing statement: %s", PQerrorMessage(conn->db));
+			talloc_free(stmt);
+			return RLM_SQL_RECONNECT;
+		}
+
+		if (PQresultStatus(conn->result) != PGRES_COMMAND_OK) {
+			rcode = sql_result_status(conn);
+			talloc_free(stmt);
+			return rcode;
+		}
+		PQclear(conn->result);
+		conn->result = NULL;
+
+		rbtree_insert(conn->statements, stmt);
+		DEBUG3("Prepared statement %s: %s", stmt->name, query);
+	}
+
+	/*
+	 *  All parameters are passed in text format.
+	 */
+	MEM(values = talloc_array(conn, char const *, num_params));
+	for (i = 0; i < num_params; i++) values[i] = params[i].value;
+
+	conn->result = PQexecPrepared(conn->db, stmt->name, num_params, values, NULL, NULL, 0);
+	talloc_free(values);
+
+	if (!conn->result) {
+		ERROR("Failed getting query result: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	return sql_result_status(conn);
+}
+
+static int sql_fd(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	if (!conn->db) return -1;
+
+	return PQsocket(conn->db);
+}
+
 static sql_rcode_t sql_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t *config, char const *query)
 {
 	return sql_query(handle, config, query);
@@ -338,6 +597,47 @@ static sql_rcode_t sql_fetch_row(rlm_sql_row_t *out, rlm_sql_handle_t *handle, U
 	return RLM_SQL_NO_MORE_ROWS;
 }
 
+/** Fetch the next row, pointing directly at the values in the result
+ *
+ * Unlike sql_fetch_row, NULL values are distinguished from empty strings.
+ */
+static sql_rcode_t sql_fetch_row_boxed(fr_value_box_t const **out, rlm_sql_handle_t *handle,
+				       UNUSED rlm_sql_config_t *config)
+{
+	int records, i;
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	*out = NULL;
+
+	if (conn->cur_row >= PQntuples(conn->result)) return RLM_SQL_NO_MORE_ROWS;
+
+	records = PQnfields(conn->result);
+	if (records <= 0) return RLM_SQL_NO_MORE_ROWS;
+
+	conn->num_fields = records;
+
+	if (!conn->boxes || (talloc_array_length(conn->boxes) != (size_t)records)) {
+		talloc_free(conn->boxes);
+		MEM(conn->boxes = talloc_array(conn, fr_value_box_t, records));
+	}
+
+	for (i = 0; i < records; i++) {
+		fr_value_box_t *value = &conn->boxes[i];
+
+		memset(value, 0, sizeof(*value));
+		if (PQgetisnull(conn->result, conn->cur_row, i)) continue;
+
+		value->type = FR_TYPE_STRING;
+		value->vb_strvalue = PQgetvalue(conn->result, conn->cur_row, i);
+		value->datum.length = PQgetlength(conn->result, conn->cur_row, i);
+	}
+	conn->cur_row++;
+
+	*out = conn->boxes;
+
+	return RLM_SQL_OK;
+}
+
 static int sql_num_fields(rlm_sql_handle_t * handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_postgres_conn_t *conn = handle->conn;
@@ -431,7 +731,6 @@ static int mod_instantiate(rlm_sql_config_t const *config, void *instance, CONF_
 {
 	rlm_sql_postgres_t	*inst = instance;
 	char 			application_name[NAMEDATALEN];
-	char			*db_string;
 
 	/*
 	 *	Allow the user to set their own, or disable it
@@ -447,65 +746,10 @@ static int mod_instantiate(rlm_sql_config_t const *config, void *instance, CONF_
 
 		snprintf(application_name, sizeof(application_name),
 			 "FreeRADIUS " RADIUSD_VERSION_STRING " - %s (%s)", main_config.name, name);
+		inst->application_name = talloc_typed_strdup(inst, application_name);
 	}
 
-	/*
-	 *	Old style database name
-	 *
-	 *	Append options if they were set in the config
-	 */
-	if (!strchr(config->sql_db, '=')) {
-		db_string = talloc_typed_asprintf(inst, "dbname='%s'", config->sql_db);
-
-		if (config->sql_server[0] != '\0') {
-			db_string = talloc_asprintf_append(db_string, " host='%s'", config->sql_server);
-		}
-
-		if (config->sql_port) {
-			db_string = talloc_asprintf_append(db_string, " port=%i", config->sql_port);
-		}
-
-		if (config->sql_login[0] != '\0') {
-			db_string = talloc_asprintf_append(db_string, " user='%s'", config->sql_login);
-		}
-
-		if (config->sql_password[0] != '\0') {
-			db_string = talloc_asprintf_append(db_string, " password='%s'", config->sql_password);
-		}
-
-		if (inst->send_application_name) {
-			db_string = talloc_asprintf_append(db_string, " application_name='%s'", application_name);
-		}
-
-	/*
-	 *	New style parameter string
-	 *
-	 *	Only append options when not already present
-	 */
-	} else {
-		db_string = talloc_typed_strdup(inst, config->sql_db);
-
-		if ((config->sql_server[0] != '\0') && !strstr(db_string, "host=")) {
-			db_string = talloc_asprintf_append(db_string, " host='%s'", config->sql_server);
-		}
-
-		if (config->sql_port && !strstr(db_string, "port=")) {
-			db_string = talloc_asprintf_append(db_string, " port=%i", config->sql_port);
-		}
-
-		if ((config->sql_login[0] != '\0') && !strstr(db_string, "user=")) {
-			db_string = talloc_asprintf_append(db_string, " user='%s'", config->sql_login);
-		}
-
-		if ((config->sql_password[0] != '\0') && !strstr(db_string, "password=")) {
-			db_string = talloc_asprintf_append(db_string, " password='%s'", config->sql_password);
-		}
-
-		if (inst->send_application_name && !strstr(db_string, "application_name=")) {
-			db_string = talloc_asprintf_append(db_string, " application_name='%s'", application_name);
-		}
-	}
-	inst->db_string = db_string;
+	inst->db_string = sql_db_string(inst, inst, config);
 
 	return 0;
 }
@@ -528,16 +772,22 @@ rlm_sql_driver_t rlm_sql_postgresql = {
 	.name				= "rlm_sql_postgresql",
 	.magic				= RLM_MODULE_INIT,
 //	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY,	/* Needs more testing */
+	.flags				= RLM_SQL_PARAM_FLAGS_NUMBERED,
 	.inst_size			= sizeof(rlm_sql_postgres_t),
 	.load				= mod_load,
 	.config				= driver_config,
 	.mod_instantiate		= mod_instantiate,
 	.sql_socket_init		= sql_socket_init,
 	.sql_query			= sql_query,
+	.sql_query_async		= sql_query_async,
+	.sql_query_async_result		= sql_query_async_result,
+	.sql_fd				= sql_fd,
+	.sql_query_prepared		= sql_query_prepared,
 	.sql_select_query		= sql_select_query,
 	.sql_num_fields			= sql_num_fields,
 	.sql_fields			= sql_fields,
 	.sql_fetch_row			= sql_fetch_row,
+	.sql_fetch_row_boxed		= sql_fetch_row_boxed,
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_free_result,
 	.sql_finish_select_query	= sql_free_result,
@@ -52,9 +52,27 @@ typedef sqlite_int64 sqlite3_int64;
 typedef struct rlm_sql_sqlite_conn {
 	sqlite3 *db;
 	sqlite3_stmt *statement;
+	bool statement_cached;		//!< statement belongs to the cache, and must be reset, not finalized.
 	int col_count;
+	rbtree_t *statements;		//!< Prepared on this connection, keyed by query.
+	fr_value_box_t *boxes;		//!< Fields of the current row, see sql_fetch_row_boxed.
 } rlm_sql_sqlite_conn_t;
 
+#ifdef HAVE_SQLITE3_PREPARE_V2
+/** A statement prepared on a connection
+ *
+ */
+typedef struct {
+	char const	*query;		//!< The statement was prepared from.
+	sqlite3_stmt	*statement;
+} rlm_sql_sqlite_stmt_t;
+
+/*
+ *	Forget every prepared statement if there are more than this.
+ */
+#  define SQLITE_MAX_STATEMENTS	256
+#endif
+
 typedef struct rlm_sql_sqlite {
 	char const	*filename;
 	uint32_t	busy_timeout;
@@ -372,6 +390,12 @@ static int _sql_socket_destructor(rlm_sql_sqlite_conn_t *conn)
 
 	DEBUG2("Socket destructor called, closing socket");
 
+	/*
+	 *	Statements must be finalized before
+	 *	the database can be closed.
+	 */
+	TALLOC_FREE(conn->statements);
+
 	if (conn->db) {
 		status = sqlite3_close(conn->db);
 		if (status != SQLITE_OK) WARN("Got SQLite error when closing socket: %s",
@@ -488,6 +512,82 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 	return sql_check_error(conn->db, status);
 }
 
+#ifdef HAVE_SQLITE3_PREPARE_V2
+static int sql_stmt_cmp(void const *one, void const *two)
+{
+	rlm_sql_sqlite_stmt_t const *a = one, *b = two;
+
+	return strcmp(a->query, b->query);
+}
+
+static void _sql_stmt_free(void *data)
+{
+	rlm_sql_sqlite_stmt_t *stmt = data;
+
+	(void) sqlite3_finalize(stmt->statement);
+}
+
+/** Execute a query with placeholders, preparing it if it hasn't been prepared on this connection
+ *
+ */
+static sql_rcode_t sql_query_prepared(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config, char const *query,
+				      sql_param_t const *params, int num_params)
+{
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	rlm_sql_sqlite_stmt_t	find, *stmt;
+	sql_rcode_t		rcode;
+	int			status = SQLITE_OK;
+	int			i;
+
+	if (!conn->statements) {
+		MEM(conn->statements = rbtree_create(conn, sql_stmt_cmp, _sql_stmt_free, RBTREE_FLAG_NONE));
+	}
+
+	find.query = query;
+	stmt = rbtree_finddata(conn->statements, &find);
+	if (!stmt) {
+		sqlite3_stmt *statement;
+
+		if (rbtree_num_elements(conn->statements) >= SQLITE_MAX_STATEMENTS) {
+			DEBUG("Too many prepared statements, finalizing them all");
+
+			talloc_free(conn->statements);
+			MEM(conn->statements = rbtree_create(conn, sql_stmt_cmp, _sql_stmt_free, RBTREE_FLAG_NONE));
+		}
+
+		status = sqlite3_prepare_v2(conn->db, query, strlen(query), &statement, NULL);
+		rcode = sql_check_error(conn->db, status);
+		if (rcode != RLM_SQL_OK) return rcode;
+
+		MEM(stmt = talloc_zero(conn->statements, rlm_sql_sqlite_stmt_t));
+		stmt->query = talloc_typed_strdup(stmt, query);
+		stmt->statement = statement;
+
+		rbtree_insert(conn->statements, stmt);
+	}
+
+	conn->statement = stmt->statement;
+	conn->statement_cached = true;
+
+	for (i = 0; i < num_params; i++) {
+		if (!params[i].numeric) {
+			status = sqlite3_bind_text(stmt->statement, i + 1, params[i].value, params[i].length,
+						   SQLITE_TRANSIENT);
+		} else if (strchr(params[i].value, '.')) {
+			status = sqlite3_bind_double(stmt->statement, i + 1, strtod(params[i].value, NULL));
+		} else {
+			status = sqlite3_bind_int64(stmt->statement, i + 1, strtoll(params[i].value, NULL, 10));
+		}
+
+		rcode = sql_check_error(conn->db, status);
+		if (rcode != RLM_SQL_OK) return rcode;
+	}
+
+	status = sqlite3_step(conn->statement);
+	return sql_check_error(conn->db, status);
+}
+#endif
+
 static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_sqlite_conn_t *conn = handle->conn;
@@ -601,6 +701,76 @@ static sql_rcode_t sql_fetch_row(rlm_sql_row_t *out, rlm_sql_handle_t *handle, r
 	return RLM_SQL_OK;
 }
 
+/** Fetch the next row, with integers and floats in their native types
+ *
+ * Strings and blobs point into SQLite's buffers, which are valid until
+ * the statement is stepped again, or reset.
+ */
+static sql_rcode_t sql_fetch_row_boxed(fr_value_box_t const **out, rlm_sql_handle_t *handle, rlm_sql_config_t *config)
+{
+	int status;
+	rlm_sql_sqlite_conn_t *conn = handle->conn;
+
+	int i = 0;
+
+	*out = NULL;
+
+	status = sqlite3_step(conn->statement);
+	if (sql_check_error(conn->db, status) != RLM_SQL_OK) return RLM_SQL_ERROR;
+	if (status == SQLITE_DONE) return RLM_SQL_NO_MORE_ROWS;
+
+	if (conn->col_count == 0) {
+		conn->col_count = sql_num_fields(handle, config);
+		if (conn->col_count == 0) return RLM_SQL_ERROR;
+	}
+
+	if (!conn->boxes || (talloc_array_length(conn->boxes) != (size_t)conn->col_count)) {
+		talloc_free(conn->boxes);
+		MEM(conn->boxes = talloc_array(conn, fr_value_box_t, conn->col_count));
+	}
+
+	for (i = 0; i < conn->col_count; i++) {
+		fr_value_box_t *value = &conn->boxes[i];
+
+		memset(value, 0, sizeof(*value));
+
+		switch (sqlite3_column_type(conn->statement, i)) {
+		case SQLITE_INTEGER:
+			value->type = FR_TYPE_INT64;
+			value->vb_int64 = sqlite3_column_int64(conn->statement, i);
+			break;
+
+		case SQLITE_FLOAT:
+			value->type = FR_TYPE_FLOAT64;
+			value->vb_float64 = sqlite3_column_double(conn->statement, i);
+			break;
+
+		case SQLITE_TEXT:
+			value->vb_strvalue = (char const *) sqlite3_column_text(conn->statement, i);
+			if (!value->vb_strvalue) break;
+
+			value->type = FR_TYPE_STRING;
+			value->datum.length = sqlite3_column_bytes(conn->statement, i);
+			break;
+
+		case SQLITE_BLOB:
+			value->vb_octets = sqlite3_column_blob(conn->statement, i);
+			if (!value->vb_octets) break;
+
+			value->type = FR_TYPE_OCTETS;
+			value->datum.length = sqlite3_column_bytes(conn->statement, i);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	*out = conn->boxes;
+
+	return RLM_SQL_OK;
+}
+
 static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_sqlite_conn_t *conn = handle->conn;
@@ -608,8 +778,14 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_conf
 	if (conn->statement) {
 		TALLOC_FREE(handle->row);
 
-		(void) sqlite3_finalize(conn->statement);
+		if (conn->statement_cached) {
+			(void) sqlite3_reset(conn->statement);
+			(void) sqlite3_clear_bindings(conn->statement);
+		} else {
+			(void) sqlite3_finalize(conn->statement);
+		}
 		conn->statement = NULL;
+		conn->statement_cached = false;
 		conn->col_count = 0;
 	}
 
@@ -799,10 +975,14 @@ rlm_sql_driver_t rlm_sql_sqlite = {
 	.mod_instantiate		= mod_instantiate,
 	.sql_socket_init		= sql_socket_init,
 	.sql_query			= sql_query,
+#ifdef HAVE_SQLITE3_PREPARE_V2
+	.sql_query_prepared		= sql_query_prepared,
+#endif
 	.sql_select_query		= sql_select_query,
 	.sql_num_fields			= sql_num_fields,
 	.sql_affected_rows		= sql_affected_rows,
 	.sql_fetch_row			= sql_fetch_row,
+	.sql_fetch_row_boxed		= sql_fetch_row_boxed,
 	.sql_fields			= sql_fields,
 	.sql_free_result		= sql_free_result,
 	.sql_error			= sql_error,
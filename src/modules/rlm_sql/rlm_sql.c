@@ -68,6 +68,8 @@ static const CONF_PARSER type_config[] = {
 static const CONF_PARSER acct_config[] = {
 	{ FR_CONF_OFFSET("reference", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sql_config_t, accounting.reference), .dflt = ".query" },
 	{ FR_CONF_OFFSET("logfile", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sql_config_t, accounting.logfile) },
+	{ FR_CONF_OFFSET("batch_size", FR_TYPE_UINT32, rlm_sql_config_t, accounting.batch_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("batch_timeout", FR_TYPE_TIMEVAL, rlm_sql_config_t, accounting.batch_timeout), .dflt = "0.01" },
 
 	{ FR_CONF_POINTER("type", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) type_config },
 	CONF_PARSER_TERMINATOR
@@ -76,6 +78,8 @@ static const CONF_PARSER acct_config[] = {
 static const CONF_PARSER postauth_config[] = {
 	{ FR_CONF_OFFSET("reference", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sql_config_t, postauth.reference), .dflt = ".query" },
 	{ FR_CONF_OFFSET("logfile", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sql_config_t, postauth.logfile) },
+	{ FR_CONF_OFFSET("batch_size", FR_TYPE_UINT32, rlm_sql_config_t, postauth.batch_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("batch_timeout", FR_TYPE_TIMEVAL, rlm_sql_config_t, postauth.batch_timeout), .dflt = "0.01" },
 
 	{ FR_CONF_OFFSET("query", FR_TYPE_STRING | FR_TYPE_XLAT | FR_TYPE_MULTI, rlm_sql_config_t, postauth.query) },
 	CONF_PARSER_TERMINATOR
@@ -91,11 +95,14 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("read_groups", FR_TYPE_BOOL, rlm_sql_config_t, read_groups), .dflt = "yes" },
 	{ FR_CONF_OFFSET("read_profiles", FR_TYPE_BOOL, rlm_sql_config_t, read_profiles), .dflt = "yes" },
 	{ FR_CONF_OFFSET("read_clients", FR_TYPE_BOOL, rlm_sql_config_t, do_clients), .dflt = "no" },
+	{ FR_CONF_OFFSET("read_clients_background", FR_TYPE_BOOL, rlm_sql_config_t, do_clients_background), .dflt = "no" },
 	{ FR_CONF_OFFSET("sql_user_name", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sql_config_t, query_user), .dflt = "" },
 	{ FR_CONF_OFFSET("group_attribute", FR_TYPE_STRING, rlm_sql_config_t, group_attribute) },
 	{ FR_CONF_OFFSET("logfile", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sql_config_t, logfile) },
 	{ FR_CONF_OFFSET("default_user_profile", FR_TYPE_STRING, rlm_sql_config_t, default_profile), .dflt = "" },
 	{ FR_CONF_OFFSET("client_query", FR_TYPE_STRING, rlm_sql_config_t, client_query), .dflt = "SELECT id,nasname,shortname,type,secret FROM nas" },
+	{ FR_CONF_OFFSET("client_refresh_query", FR_TYPE_STRING, rlm_sql_config_t, client_refresh_query) },
+	{ FR_CONF_OFFSET("client_refresh_interval", FR_TYPE_UINT32, rlm_sql_config_t, client_refresh_interval), .dflt = "0" },
 	{ FR_CONF_OFFSET("open_query", FR_TYPE_STRING, rlm_sql_config_t, connect_query) },
 
 	{ FR_CONF_OFFSET("authorize_check_query", FR_TYPE_STRING | FR_TYPE_XLAT | FR_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_check_query) },
@@ -111,12 +118,32 @@ static const CONF_PARSER module_config[] = {
 	 */
 	{ FR_CONF_OFFSET("query_timeout", FR_TYPE_UINT32, rlm_sql_config_t, query_timeout) },
 
+	{ FR_CONF_OFFSET("map_cache_lifetime", FR_TYPE_UINT32, rlm_sql_config_t, map_cache_lifetime), .dflt = "0" },
+	{ FR_CONF_OFFSET("prepared_statements", FR_TYPE_BOOL, rlm_sql_config_t, prepared_statements), .dflt = "yes" },
+
+	{ FR_CONF_OFFSET("replica_lag_query", FR_TYPE_STRING, rlm_sql_config_t, replica_lag_query) },
+	{ FR_CONF_OFFSET("replica_max_lag", FR_TYPE_UINT32, rlm_sql_config_t, replica_max_lag), .dflt = "0" },
+	{ FR_CONF_OFFSET("replica_check_interval", FR_TYPE_UINT32, rlm_sql_config_t, replica_check_interval), .dflt = "10" },
+
 	{ FR_CONF_POINTER("accounting", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) acct_config },
 
 	{ FR_CONF_POINTER("post-auth", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) postauth_config },
 	CONF_PARSER_TERMINATOR
 };
 
+/*
+ *	Connection details which may be set for each replica.  Anything
+ *	not set is taken from the main configuration.
+ */
+static const CONF_PARSER replica_config[] = {
+	{ FR_CONF_OFFSET("server", FR_TYPE_STRING, rlm_sql_config_t, sql_server) },
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT32, rlm_sql_config_t, sql_port) },
+	{ FR_CONF_OFFSET("login", FR_TYPE_STRING, rlm_sql_config_t, sql_login) },
+	{ FR_CONF_OFFSET("password", FR_TYPE_STRING | FR_TYPE_SECRET, rlm_sql_config_t, sql_password) },
+	{ FR_CONF_OFFSET("radius_db", FR_TYPE_STRING, rlm_sql_config_t, sql_db) },
+	CONF_PARSER_TERMINATOR
+};
+
 static size_t sql_escape_for_xlat_func(REQUEST *request, char *out, size_t outlen, char const *in, void *arg);
 
 /*
@@ -133,7 +160,7 @@ static sql_fall_through_t fall_through(VALUE_PAIR *vp)
 /*
  *	Yucky prototype.
  */
-static int generate_sql_clients(rlm_sql_t *inst);
+static int generate_sql_clients(rlm_sql_t *inst, char const *query, bool replace);
 static size_t sql_escape_func(REQUEST *, char *out, size_t outlen, char const *in, void *arg);
 
 /** Execute an arbitrary SQL query
@@ -153,16 +180,24 @@ static ssize_t sql_xlat(UNUSED TALLOC_CTX *ctx, char **out, UNUSED size_t outlen
 	ssize_t			ret = 0;
 	char const		*p;
 
-	handle = fr_pool_connection_get(inst->pool, request);	/* connection pool should produce error */
-	if (!handle) return 0;
-
-	rlm_sql_query_log(inst, request, NULL, fmt);
-
 	/*
 	 *	Trim whitespace for the prefix check
 	 */
 	for (p = fmt; is_whitespace(p); p++);
 
+	/*
+	 *	Only queries which are obviously read only
+	 *	can go to a replica.
+	 */
+	if (strncasecmp(p, "select", 6) == 0) {
+		handle = sql_read_handle_get(inst, request);
+	} else {
+		handle = fr_pool_connection_get(inst->pool, request);	/* connection pool should produce error */
+	}
+	if (!handle) return 0;
+
+	rlm_sql_query_log(inst, request, NULL, fmt);
+
 	/*
 	 *	If the query starts with any of the following prefixes,
 	 *	then return the number of rows affected
@@ -229,7 +264,7 @@ static ssize_t sql_xlat(UNUSED TALLOC_CTX *ctx, char **out, UNUSED size_t outlen
 	(inst->driver->sql_finish_select_query)(handle, inst->config);
 
 finish:
-	fr_pool_connection_release(inst->pool, request, handle);
+	sql_handle_release(inst, request, handle);
 
 	return ret;
 }
@@ -247,18 +282,18 @@ finish:
  */
 static int _sql_map_proc_get_value(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *request, vp_map_t const *map, void *uctx)
 {
-	VALUE_PAIR	*vp;
-	char const	*value = uctx;
+	VALUE_PAIR		*vp;
+	fr_value_box_t const	*value = uctx;
 
 	vp = fr_pair_afrom_da(ctx, map->lhs->tmpl_da);
 	/*
 	 *	Buffer not always talloced, sometimes it's
 	 *	just a pointer to a field in a result struct.
 	 */
-	if (fr_pair_value_from_str(vp, value, strlen(value)) < 0) {
+	if (sql_pair_value_from_box(vp, value) < 0) {
 		char *escaped;
 
-		escaped = fr_asprint(vp, value, talloc_array_length(value) - 1, '"');
+		escaped = fr_value_box_asprint(vp, value, '"');
 		REDEBUG("Failed parsing value \"%s\" for attribute %s: %s", escaped,
 			map->lhs->tmpl_da->name, fr_strerror());
 		talloc_free(vp); /* also frees escaped */
@@ -287,7 +322,207 @@ static int sql_map_verify(CONF_SECTION *cs, UNUSED void *mod_inst, UNUSED void *
 	return 0;
 }
 
+#define MAX_SQL_FIELD_INDEX (64)
+#define SQL_MAP_CACHE_MAX (1024)
+
+/** A result set shared by identical map queries
+ *
+ * Accounting bursts often run the same map query for many requests in
+ * quick succession.  When map_cache_lifetime is set, the rows returned
+ * by the first query are kept, and replayed for any identical query
+ * expanded before the entry expires.
+ */
+typedef struct {
+	char const	*query;			//!< Expanded query string, the key.
+	time_t		expires;		//!< When the entry stops being used.
+	char const	**fields;		//!< Field names of the result set.
+	fr_value_box_t	**rows;			//!< Copies of the rows returned.
+} sql_map_cache_t;
+
+static int sql_map_cache_cmp(void const *one, void const *two)
+{
+	sql_map_cache_t const *a = one, *b = two;
+
+	return strcmp(a->query, b->query);
+}
+
+static int _sql_map_cache_expire(void *ctx, void *data)
+{
+	time_t		*now = ctx;
+	sql_map_cache_t	*c = data;
+
+	return (c->expires <= *now) ? 2 : 0;
+}
+
+/** Resolve the RHS of each map to an index in the result set
+ *
+ * @param[out] field_index	Index of the field each map refers to, or -1.
+ * @param[in] request		The current request.
+ * @param[in] maps		Head of the map list.
+ * @param[in] fields		Field names from the result set.
+ * @param[in] field_cnt		Number of fields.
+ * @return
+ *	- 1 if one or more maps matched a field.
+ *	- 0 if no maps matched.
+ *	- -1 on error.
+ */
+static int sql_map_fields(int field_index[], REQUEST *request, vp_map_t const *maps,
+			  char const **fields, int field_cnt)
+{
+	vp_map_t const	*map;
+	char const	*map_rhs;
+	char		map_rhs_buff[128];
+	bool		found_field = false;
+	int		i, j;
+
+	for (i = 0; i < MAX_SQL_FIELD_INDEX; i++) field_index[i] = -1;
+
+	/*
+	 *	Iterate over the maps, it's O(N2)ish but probably
+	 *	faster than building a radix tree each time the
+	 *	map set is evaluated (map->rhs can be dynamic).
+	 */
+	for (map = maps, i = 0;
+	     map && (i < MAX_SQL_FIELD_INDEX);
+	     map = map->next, i++) {
+		/*
+		 *	Expand the RHS to get the name of the SQL field
+		 */
+		if (tmpl_expand(&map_rhs, map_rhs_buff, sizeof(map_rhs_buff),
+				request, map->rhs, NULL, NULL) < 0) {
+			RPERROR("Failed getting field name");
+			return -1;
+		}
+
+		for (j = 0; j < field_cnt; j++) {
+			if (strcmp(fields[j], map_rhs) != 0) continue;
+			field_index[i] = j;
+			found_field = true;
+		}
+	}
+
+	return found_field ? 1 : 0;
+}
+
+/** Convert the values of a single row into VALUE_PAIRs
+ *
+ */
+static int sql_map_row(REQUEST *request, vp_map_t const *maps, int const field_index[], fr_value_box_t const *row)
+{
+	vp_map_t const	*map;
+	int		j;
+	size_t		num_fields = talloc_array_length(row);
+	fr_value_box_t const	*field;
+	void		*value;
+
+	for (map = maps, j = 0;
+	     map && (j < MAX_SQL_FIELD_INDEX);
+	     map = map->next, j++) {
+		if (field_index[j] < 0) continue;	/* We didn't find the map RHS in the field set */
+		if ((size_t)field_index[j] >= num_fields) continue;
+
+		field = &row[field_index[j]];
+		if (field->type == FR_TYPE_INVALID) {
+			RDEBUG3("Field for %s is NULL, skipping", map->lhs->name);
+			continue;
+		}
+
+		memcpy(&value, &field, sizeof(value));
+		if (map_to_request(request, map, _sql_map_proc_get_value, value) < 0) return -1;
+	}
+
+	return 0;
+}
+
+/** Replay a cached result set for an identical query
+ *
+ * @return
+ *	- true if a live entry was found, and rcode was set.
+ *	- false if the query has to be run.
+ */
+static bool sql_map_cache_apply(rlm_sql_t *inst, REQUEST *request, char const *query_str,
+				vp_map_t const *maps, rlm_rcode_t *rcode)
+{
+	sql_map_cache_t	*c, my_c = { .query = query_str };
+	int		field_index[MAX_SQL_FIELD_INDEX];
+	size_t		i, num_rows;
+	time_t		now = time(NULL);
+
+	pthread_mutex_lock(&inst->map_cache_mutex);
+	c = rbtree_finddata(inst->map_cache, &my_c);
+	if (!c) {
+		pthread_mutex_unlock(&inst->map_cache_mutex);
+		return false;
+	}
+
+	if (c->expires <= now) {
+		rbtree_deletebydata(inst->map_cache, c);
+		pthread_mutex_unlock(&inst->map_cache_mutex);
+		return false;
+	}
+
+	RDEBUG2("Using result set of an identical query, expires in %" PRIu64 "s", (uint64_t)(c->expires - now));
+
+	num_rows = talloc_array_length(c->rows);
+	if (num_rows == 0) {
+		RDEBUG("SQL query returned no results");
+		*rcode = RLM_MODULE_NOOP;
+		goto finish;
+	}
+
+	switch (sql_map_fields(field_index, request, maps, c->fields, talloc_array_length(c->fields))) {
+	case 1:
+		break;
+
+	case 0:
+		RDEBUG("No fields matching map found in query result");
+		*rcode = RLM_MODULE_NOOP;
+		goto finish;
+
+	default:
+		*rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	*rcode = RLM_MODULE_UPDATED;
+	for (i = 0; i < num_rows; i++) {
+		if (sql_map_row(request, maps, field_index, c->rows[i]) < 0) {
+			*rcode = RLM_MODULE_FAIL;
+			break;
+		}
+	}
+
+finish:
+	pthread_mutex_unlock(&inst->map_cache_mutex);
+
+	return true;
+}
+
+/** Store a result set so identical queries can use it
+ *
+ * Takes ownership of the entry.
+ */
+static void sql_map_cache_add(rlm_sql_t *inst, sql_map_cache_t *c)
+{
+	time_t now = time(NULL);
+
+	c->expires = now + inst->config->map_cache_lifetime;
+
+	pthread_mutex_lock(&inst->map_cache_mutex);
+	if (rbtree_num_elements(inst->map_cache) >= SQL_MAP_CACHE_MAX) {
+		rbtree_walk(inst->map_cache, RBTREE_DELETE_ORDER, _sql_map_cache_expire, &now);
+	}
+
+	if ((rbtree_num_elements(inst->map_cache) >= SQL_MAP_CACHE_MAX) || !rbtree_insert(inst->map_cache, c)) {
+		talloc_free(c);
+	}
+	pthread_mutex_unlock(&inst->map_cache_mutex);
+}
+
 /** Executes a SELECT query and maps the result to server attributes
+ *
+ * If map_cache_lifetime is set, the result set is also kept for
+ * identical queries, see #sql_map_cache_t.
  *
  * @param mod_inst #rlm_sql_t instance.
  * @param proc_inst Instance data for this specific mod_proc call (unused).
@@ -305,26 +540,22 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	rlm_sql_t		*inst = talloc_get_type_abort(mod_inst, rlm_sql_t);
 	rlm_sql_handle_t	*handle = NULL;
 
-	int			i, j;
+	int			j;
 
 	rlm_rcode_t		rcode = RLM_MODULE_UPDATED;
 	sql_rcode_t		ret;
 
-	vp_map_t const		*map;
-
-	rlm_sql_row_t		row;
+	fr_value_box_t const	*row;
 
 	int			rows = 0;
 	int			field_cnt;
-	char const		**fields = NULL, *map_rhs;
-	char			map_rhs_buff[128];
+	char const		**fields = NULL;
 
 	char			*query_str = NULL;
 
-#define MAX_SQL_FIELD_INDEX (64)
+	sql_map_cache_t		*c = NULL;
 
 	int			field_index[MAX_SQL_FIELD_INDEX];
-	bool			found_field = false;	/* Did we find any matching fields in the result set ? */
 
 	rad_assert(inst->driver->sql_fields);		/* Should have been caught during validation... */
 
@@ -332,7 +563,15 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 		return RLM_MODULE_FAIL;
 	}
 
-	for (i = 0; i < MAX_SQL_FIELD_INDEX; i++) field_index[i] = -1;
+	if (inst->map_cache) {
+		if (sql_map_cache_apply(inst, request, query_str, maps, &rcode)) {
+			talloc_free(query_str);
+			return rcode;
+		}
+
+		MEM(c = talloc_zero(NULL, sql_map_cache_t));
+		c->query = talloc_steal(c, query_str);
+	}
 
 	/*
 	 *	Add SQL-User-Name attribute just in case it is needed
@@ -341,7 +580,7 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	 */
 	sql_set_user(inst, request, NULL);
 
-	handle = fr_pool_connection_get(inst->pool, request);		/* connection pool should produce error */
+	handle = sql_read_handle_get(inst, request);			/* connection pool should produce error */
 	if (!handle) {
 		rcode = RLM_MODULE_FAIL;
 		goto finish;
@@ -365,6 +604,10 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 			RDEBUG2("Server returned an empty result");
 			rcode = RLM_MODULE_NOOP;
 			(inst->driver->sql_finish_select_query)(handle, inst->config);
+			if (c) {
+				sql_map_cache_add(inst, c);
+				c = NULL;
+			}
 			goto finish;
 		}
 
@@ -390,39 +633,28 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 
 	if (RDEBUG_ENABLED3) for (j = 0; j < field_cnt; j++) RDEBUG3("Got field: %s", fields[j]);
 
-	/*
-	 *	Iterate over the maps, it's O(N2)ish but probably
-	 *	faster than building a radix tree each time the
-	 *	map set is evaluated (map->rhs can be dynamic).
-	 */
-	for (map = maps, i = 0;
-	     map && (i < MAX_SQL_FIELD_INDEX);
-	     map = map->next, i++) {
-		/*
-		 *	Expand the RHS to get the name of the SQL field
-		 */
-		if (tmpl_expand(&map_rhs, map_rhs_buff, sizeof(map_rhs_buff),
-				request, map->rhs, NULL, NULL) < 0) {
-			RPERROR("Failed getting field name");
-			goto error;
-		}
-
-		for (j = 0; j < field_cnt; j++) {
-			if (strcmp(fields[j], map_rhs) != 0) continue;
-			field_index[i] = j;
-			found_field = true;
-		}
-	}
+	switch (sql_map_fields(field_index, request, maps, fields, field_cnt)) {
+	case 1:
+		break;
 
 	/*
 	 *	Couldn't resolve any map RHS values to fields
 	 *	in the result set.
 	 */
-	if (!found_field) {
+	case 0:
 		RDEBUG("No fields matching map found in query result");
 		rcode = RLM_MODULE_NOOP;
 		(inst->driver->sql_finish_select_query)(handle, inst->config);
 		goto finish;
+
+	default:
+		goto error;
+	}
+
+	if (c) {
+		MEM(c->fields = talloc_array(c, char const *, field_cnt));
+		for (j = 0; j < field_cnt; j++) MEM(c->fields[j] = talloc_strdup(c->fields, fields[j]));
+		MEM(c->rows = talloc_array(c, fr_value_box_t *, 0));
 	}
 
 	/*
@@ -432,13 +664,20 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	 *	Note: Not all SQL client libraries provide a row count,
 	 *	so we have to do the count here.
 	 */
-	while (((ret = rlm_sql_fetch_row(&row, inst, request, &handle)) == RLM_SQL_OK)) {
+	while (((ret = rlm_sql_fetch_row_boxed(&row, inst, request, &handle)) == RLM_SQL_OK)) {
 		rows++;
-		for (map = maps, j = 0;
-		     map && (j < MAX_SQL_FIELD_INDEX);
-		     map = map->next, j++) {
-			if (field_index[j] < 0) continue;	/* We didn't find the map RHS in the field set */
-			if (map_to_request(request, map, _sql_map_proc_get_value, row[field_index[j]]) < 0) goto error;
+		if (sql_map_row(request, maps, field_index, row) < 0) goto error;
+
+		if (c) {
+			fr_value_box_t	*copy;
+			size_t		i, num_fields = talloc_array_length(row);
+
+			MEM(c->rows = talloc_realloc(c, c->rows, fr_value_box_t *, rows));
+			MEM(copy = c->rows[rows - 1] = talloc_zero_array(c->rows, fr_value_box_t, num_fields));
+			for (i = 0; i < num_fields; i++) {
+				if (row[i].type == FR_TYPE_INVALID) continue;
+				MEM(fr_value_box_copy(copy, &copy[i], &row[i]) == 0);
+			}
 		}
 	}
 
@@ -451,31 +690,54 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 
 	(inst->driver->sql_finish_select_query)(handle, inst->config);
 
+	if (c) {
+		sql_map_cache_add(inst, c);
+		c = NULL;
+	}
+
 finish:
-	talloc_free(query_str);
+	if (c) {
+		talloc_free(c);		/* also frees query_str */
+	} else if (!inst->map_cache) {
+		talloc_free(query_str);
+	}
 	talloc_free(fields);
-	fr_pool_connection_release(inst->pool, request, handle);
+	sql_handle_release(inst, request, handle);
 
 	return rcode;
 }
 
-static int generate_sql_clients(rlm_sql_t *inst)
+/** Read clients from the database
+ *
+ * @param[in] inst	of rlm_sql.
+ * @param[in] query	to select the clients with.
+ * @param[in] replace	If true, clients which have changed replace the
+ *			ones already loaded, instead of being an error.
+ * @return
+ *	- The number of rows read.
+ *	- -1 on error.
+ */
+static int generate_sql_clients(rlm_sql_t *inst, char const *query, bool replace)
 {
 	rlm_sql_handle_t *handle;
 	rlm_sql_row_t row;
 	unsigned int i = 0;
 	int ret = 0;
 	RADCLIENT *c;
+	bool added;
 
 	DEBUG("Processing generate_sql_clients");
-	DEBUG("Query is: %s", inst->config->client_query);
+	DEBUG("Query is: %s", query);
 
 	handle = fr_pool_connection_get(inst->pool, NULL);
 	if (!handle) return -1;
 
-	if (rlm_sql_select_query(inst, NULL, &handle, inst->config->client_query) != RLM_SQL_OK) return -1;
+	if (rlm_sql_select_query(inst, NULL, &handle, query) != RLM_SQL_OK) {
+		if (handle) fr_pool_connection_release(inst->pool, NULL, handle);
+		return -1;
+	}
 
-	while (rlm_sql_fetch_row(&row, inst, NULL, &handle) == RLM_SQL_OK) {
+	while (!inst->clients_stop && (rlm_sql_fetch_row(&row, inst, NULL, &handle) == RLM_SQL_OK)) {
 		char *server = NULL;
 		i++;
 
@@ -525,7 +787,12 @@ static int generate_sql_clients(rlm_sql_t *inst)
 			continue;
 		}
 
-		if (!client_add(NULL, c)) {
+#ifdef WITH_DYNAMIC_CLIENTS
+		added = replace ? client_replace(NULL, c) : client_add(NULL, c);
+#else
+		added = client_add(NULL, c);
+#endif
+		if (!added) {
 			WARN("Failed to add client, possible duplicate?");
 
 			client_free(c);
@@ -539,7 +806,56 @@ static int generate_sql_clients(rlm_sql_t *inst)
 	(inst->driver->sql_finish_select_query)(handle, inst->config);
 	fr_pool_connection_release(inst->pool, NULL, handle);
 
-	return ret;
+	if (ret < 0) return ret;
+
+	return i;
+}
+
+/** Read clients after the server has started, and pick up changes to them
+ *
+ */
+static void *sql_clients_thread(void *arg)
+{
+	rlm_sql_t		*inst = talloc_get_type_abort(arg, rlm_sql_t);
+	char const		*query;
+	struct timespec		when;
+	int			num;
+
+	if (inst->config->do_clients_background) {
+		num = generate_sql_clients(inst, inst->config->client_query, false);
+		if (num < 0) {
+			ERROR("Failed to load clients from SQL");
+		} else {
+			INFO("Loaded %i clients from SQL", num);
+		}
+	}
+
+	if (!inst->config->client_refresh_interval) return NULL;
+
+	query = inst->config->client_refresh_query ? inst->config->client_refresh_query : inst->config->client_query;
+
+	pthread_mutex_lock(&inst->clients_mutex);
+	while (!inst->clients_stop) {
+		clock_gettime(CLOCK_REALTIME, &when);
+		when.tv_sec += inst->config->client_refresh_interval;
+
+		while (!inst->clients_stop &&
+		       (pthread_cond_timedwait(&inst->clients_cond, &inst->clients_mutex, &when) != ETIMEDOUT));
+		if (inst->clients_stop) break;
+		pthread_mutex_unlock(&inst->clients_mutex);
+
+		num = generate_sql_clients(inst, query, true);
+		if (num < 0) {
+			ERROR("Failed to refresh clients from SQL");
+		} else {
+			DEBUG("Refreshed %i clients from SQL", num);
+		}
+
+		pthread_mutex_lock(&inst->clients_mutex);
+	}
+	pthread_mutex_unlock(&inst->clients_mutex);
+
+	return NULL;
 }
 
 /** xlat escape function for drivers which do not provide their own
@@ -662,13 +978,13 @@ static size_t sql_escape_for_xlat_func(REQUEST *request, char *out, size_t outle
 	rlm_sql_t		*inst = talloc_get_type_abort(arg, rlm_sql_t);
 	rlm_sql_handle_t	*handle;
 
-	handle = fr_pool_connection_get(inst->pool, request);
+	handle = sql_read_handle_get(inst, request);
 	if (!handle) {
 		out[0] = '\0';
 		return 0;
 	}
 	ret = inst->sql_escape_func(request, out, outlen, in, handle);
-	fr_pool_connection_release(inst->pool, request, handle);
+	sql_handle_release(inst, request, handle);
 
 	return ret;
 }
@@ -725,7 +1041,6 @@ int sql_set_user(rlm_sql_t const *inst, REQUEST *request, char const *username)
 /*
  *	Do a set/unset user, so it's a bit clearer what's going on.
  */
-#define sql_unset_user(_i, _r) fr_pair_delete_by_num(&_r->packet->vps, _i->sql_user->vendor, _i->sql_user->attr, TAG_ANY)
 
 static int sql_get_grouplist(rlm_sql_t const *inst, rlm_sql_handle_t **handle, REQUEST *request,
 			     rlm_sql_grouplist_t **phead)
@@ -817,7 +1132,7 @@ static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 	/*
 	 *	Get a socket for this lookup
 	 */
-	handle = fr_pool_connection_get(inst->pool, request);
+	handle = sql_read_handle_get(inst, request);
 	if (!handle) {
 		return 1;
 	}
@@ -827,7 +1142,7 @@ static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 	 */
 	if (sql_get_grouplist(inst, &handle, request, &head) < 0) {
 		REDEBUG("Error getting group membership");
-		fr_pool_connection_release(inst->pool, request, handle);
+		sql_handle_release(inst, request, handle);
 		return 1;
 	}
 
@@ -836,14 +1151,14 @@ static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 			RDEBUG("sql_groupcmp finished: User is a member of group %s",
 			       check->vp_strvalue);
 			talloc_free(head);
-			fr_pool_connection_release(inst->pool, request, handle);
+			sql_handle_release(inst, request, handle);
 			return 0;
 		}
 	}
 
 	/* Free the grouplist */
 	talloc_free(head);
-	fr_pool_connection_release(inst->pool, request, handle);
+	sql_handle_release(inst, request, handle);
 
 	RDEBUG("sql_groupcmp finished: User is NOT a member of group %s", check->vp_strvalue);
 
@@ -1019,9 +1334,31 @@ finish:
 static int mod_detach(void *instance)
 {
 	rlm_sql_t	*inst = talloc_get_type_abort(instance, rlm_sql_t);
+	size_t		i;
+
+	if (inst->clients_running) {
+		pthread_mutex_lock(&inst->clients_mutex);
+		inst->clients_stop = true;
+		pthread_cond_signal(&inst->clients_cond);
+		pthread_mutex_unlock(&inst->clients_mutex);
+
+		pthread_join(inst->clients_thread, NULL);
+		pthread_mutex_destroy(&inst->clients_mutex);
+		pthread_cond_destroy(&inst->clients_cond);
+	}
 
 	if (inst->pool) fr_pool_free(inst->pool);
 
+	for (i = 0; i < talloc_array_length(inst->replicas); i++) {
+		if (inst->replicas[i]->pool) fr_pool_free(inst->replicas[i]->pool);
+		pthread_mutex_destroy(&inst->replicas[i]->mutex);
+	}
+
+	if (inst->map_cache) {
+		TALLOC_FREE(inst->map_cache);
+		pthread_mutex_destroy(&inst->map_cache_mutex);
+	}
+
 	/*
 	 *	We need to explicitly free all children, so if the driver
 	 *	parented any memory off the instance, their destructors
@@ -1035,6 +1372,54 @@ static int mod_detach(void *instance)
 	return 0;
 }
 
+/** Create a connection pool for each "replica" section
+ *
+ */
+static int sql_replicas_init(rlm_sql_t *inst, CONF_SECTION *conf)
+{
+	CONF_SECTION		*cs = NULL;
+	rlm_sql_replica_t	*replica;
+	size_t			num = 0;
+	char			log_prefix[128];
+	char			trigger_prefix[128];
+
+	snprintf(trigger_prefix, sizeof(trigger_prefix), "modules.%s.pool", cf_section_name1(conf));
+
+	while ((cs = cf_section_find_next(conf, cs, "replica", CF_IDENT_ANY))) {
+		MEM(replica = talloc_zero(inst, rlm_sql_replica_t));
+		replica->inst = inst;
+		replica->cs = cs;
+		replica->config = *inst->config;
+		pthread_mutex_init(&replica->mutex, NULL);
+
+		MEM(inst->replicas = talloc_realloc(inst, inst->replicas, rlm_sql_replica_t *, num + 1));
+		inst->replicas[num++] = replica;
+
+		if (cf_section_rules_push(cs, replica_config) < 0) return -1;
+		if (cf_section_parse(replica, &replica->config, cs) < 0) {
+			cf_log_err(cs, "Failed parsing replica configuration");
+			return -1;
+		}
+
+		replica->name = cf_section_name2(cs);
+		if (!replica->name) replica->name = replica->config.sql_server;
+
+		INFO("Attempting to connect to replica \"%s\"", replica->name);
+
+		snprintf(log_prefix, sizeof(log_prefix), "rlm_sql (%s) - replica %s", inst->name, replica->name);
+		replica->pool = module_connection_pool_init(cs, replica, mod_replica_conn_create, NULL,
+							    log_prefix, trigger_prefix, NULL);
+		if (!replica->pool) return -1;
+	}
+
+	if (num && inst->config->replica_max_lag && !inst->config->replica_lag_query) {
+		cf_log_err(conf, "replica_max_lag requires replica_lag_query");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
 	rlm_sql_t	*inst = talloc_get_type_abort(instance, rlm_sql_t);
@@ -1218,6 +1603,15 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 				inst->driver->sql_escape_func :
 				sql_escape_func;
 
+	if (inst->config->map_cache_lifetime) {
+		inst->map_cache = rbtree_create(inst, sql_map_cache_cmp, rbtree_node_talloc_free, 0);
+		if (!inst->map_cache) {
+			ERROR("Failed creating map cache");
+			return -1;
+		}
+		pthread_mutex_init(&inst->map_cache_mutex, NULL);
+	}
+
 	inst->ef = module_exfile_init(inst, conf, 256, 30, true, NULL, NULL);
 	if (!inst->ef) {
 		cf_log_err(conf, "Failed creating log file context");
@@ -1232,13 +1626,34 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->pool = module_connection_pool_init(inst->cs, inst, mod_conn_create, NULL, NULL, NULL, NULL);
 	if (!inst->pool) return -1;
 
-	if (inst->config->do_clients) {
-		if (generate_sql_clients(inst) == -1){
+	if (sql_replicas_init(inst, conf) < 0) return -1;
+
+	if (inst->config->do_clients && !inst->config->do_clients_background) {
+		if (generate_sql_clients(inst, inst->config->client_query, false) < 0) {
 			ERROR("Failed to load clients from SQL");
 			return -1;
 		}
 	}
 
+	/*
+	 *	Loading clients in the background lets the server
+	 *	answer the clients it already knows about, while
+	 *	the rest are read.
+	 */
+	if (inst->config->do_clients &&
+	    (inst->config->do_clients_background || inst->config->client_refresh_interval)) {
+		pthread_mutex_init(&inst->clients_mutex, NULL);
+		pthread_cond_init(&inst->clients_cond, NULL);
+
+		if (pthread_create(&inst->clients_thread, NULL, sql_clients_thread, inst) != 0) {
+			ERROR("Failed creating client thread: %s", fr_syserror(errno));
+			pthread_mutex_destroy(&inst->clients_mutex);
+			pthread_cond_destroy(&inst->clients_cond);
+			return -1;
+		}
+		inst->clients_running = true;
+	}
+
 	return RLM_MODULE_OK;
 }
 
@@ -1285,7 +1700,7 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 	 *	After this point use goto error or goto release to cleanup socket temporary pairlists and
 	 *	temporary attributes.
 	 */
-	handle = fr_pool_connection_get(inst->pool, request);
+	handle = sql_read_handle_get(inst, request);
 	if (!handle) {
 		rcode = RLM_MODULE_FAIL;
 		goto error;
@@ -1478,7 +1893,7 @@ release:
 		rcode = RLM_MODULE_NOTFOUND;
 	}
 
-	fr_pool_connection_release(inst->pool, request, handle);
+	sql_handle_release(inst, request, handle);
 	sql_unset_user(inst, request);
 
 	return rcode;
@@ -1488,11 +1903,261 @@ error:
 	fr_pair_list_free(&reply_tmp);
 	sql_unset_user(inst, request);
 
-	fr_pool_connection_release(inst->pool, request, handle);
+	sql_handle_release(inst, request, handle);
+
+	return rcode;
+}
+
+/** State for an accounting or post-auth query set which is waiting on the database
+ *
+ */
+typedef struct {
+	rlm_sql_t const		*inst;		//!< Module instance.
+	sql_acct_section_t	*section;	//!< The queries came from.
+	rlm_sql_handle_t	*handle;	//!< The query was sent with.
+	CONF_PAIR		*pair;		//!< The query currently being executed.
+	char const		*attr;		//!< Name of the set of redundant queries.
+	int			fd;		//!< We're waiting for a result on, or -1.
+	int			tries;		//!< Number of times the current query was sent.
+	sql_rcode_t		sql_ret;	//!< What the driver returned.
+} sql_acct_async_t;
+
+static rlm_rcode_t acct_async_send(REQUEST *request, sql_acct_async_t *state);
+
+/** Stop waiting for events on the handle's file descriptor
+ *
+ */
+static void acct_async_fd_delete(REQUEST *request, sql_acct_async_t *state)
+{
+	if (state->fd < 0) return;
+
+	(void) unlang_event_fd_delete(request, state, state->fd);
+	state->fd = -1;
+}
+
+/** Release all resources used by the query set, and return its rcode
+ *
+ */
+static rlm_rcode_t acct_async_finish(REQUEST *request, sql_acct_async_t *state, rlm_rcode_t rcode)
+{
+	rlm_sql_t const *inst = state->inst;
+
+	acct_async_fd_delete(request, state);
+	fr_pool_connection_release(inst->pool, request, state->handle);
+	sql_unset_user(inst, request);
+	talloc_free(state);
 
 	return rcode;
 }
 
+/** Called when the handle's file descriptor is readable
+ *
+ * Polls the driver for the result, and resumes the request once
+ * it's available.
+ */
+static void acct_async_read(REQUEST *request, void *instance, UNUSED void *thread, void *ctx, UNUSED int fd)
+{
+	sql_acct_async_t	*state = talloc_get_type_abort(ctx, sql_acct_async_t);
+	sql_rcode_t		ret;
+
+	ret = rlm_sql_query_async_result(instance, request, state->handle);
+	if (ret == RLM_SQL_YIELD) return;
+
+	state->sql_ret = ret;
+	acct_async_fd_delete(request, state);
+	unlang_resumable(request);
+}
+
+/** Called when there's an error on the handle's file descriptor
+ *
+ */
+static void acct_async_error(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx, UNUSED int fd)
+{
+	sql_acct_async_t	*state = talloc_get_type_abort(ctx, sql_acct_async_t);
+
+	REDEBUG("Connection to the database failed whilst waiting for a result");
+
+	state->sql_ret = RLM_SQL_RECONNECT;
+	acct_async_fd_delete(request, state);
+	unlang_resumable(request);
+}
+
+/** Process the result of a query, and send the next one if required
+ *
+ */
+static rlm_rcode_t acct_async_process(REQUEST *request, sql_acct_async_t *state)
+{
+	rlm_sql_t const		*inst = state->inst;
+	int			numaffected;
+
+	RDEBUG("SQL query returned: %s", fr_int2str(sql_rcode_table, state->sql_ret, "<INVALID>"));
+
+	switch (state->sql_ret) {
+	/*
+	 *  Query was a success! Now we just need to check if it did anything.
+	 */
+	case RLM_SQL_OK:
+		numaffected = (inst->driver->sql_affected_rows)(state->handle, inst->config);
+		(inst->driver->sql_finish_query)(state->handle, inst->config);
+		RDEBUG("%i record(s) updated", numaffected);
+
+		if (numaffected > 0) return acct_async_finish(request, state, RLM_MODULE_OK);
+		break;
+
+	/*
+	 *  The connection failed after the query was sent.  Send
+	 *  it again on a new connection, as rlm_sql_query would.
+	 */
+	case RLM_SQL_RECONNECT:
+		if (state->tries > (int)fr_pool_state(inst->pool)->num) {
+			RERROR("Hit reconnection limit");
+			return acct_async_finish(request, state, RLM_MODULE_FAIL);
+		}
+
+		state->handle = fr_pool_connection_reconnect(inst->pool, request, state->handle);
+		if (!state->handle) return acct_async_finish(request, state, RLM_MODULE_FAIL);
+
+		return acct_async_send(request, state);
+
+	case RLM_SQL_QUERY_INVALID:
+		return acct_async_finish(request, state, RLM_MODULE_INVALID);
+
+	case RLM_SQL_ALT_QUERY:
+		break;
+
+	default:
+		return acct_async_finish(request, state, RLM_MODULE_FAIL);
+	}
+
+	/*
+	 *  We assume all entries with the same name form a redundant
+	 *  set of queries.
+	 */
+	state->pair = cf_pair_find_next(state->section->cs, state->pair, state->attr);
+	if (!state->pair) {
+		RDEBUG("No additional queries configured");
+		return acct_async_finish(request, state, RLM_MODULE_NOOP);
+	}
+
+	RDEBUG("Trying next query...");
+	state->tries = 0;
+
+	return acct_async_send(request, state);
+}
+
+static rlm_rcode_t acct_async_resume(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx)
+{
+	return acct_async_process(request, talloc_get_type_abort(ctx, sql_acct_async_t));
+}
+
+/** Cancel an outstanding query if the request is stopped
+ *
+ * The connection still has the query in progress, so it can't be
+ * returned to the pool.  Close it instead.
+ */
+static void acct_async_signal(REQUEST *request, void *instance, UNUSED void *thread, void *ctx,
+			      fr_state_action_t action)
+{
+	rlm_sql_t const		*inst = instance;
+	sql_acct_async_t	*state = talloc_get_type_abort(ctx, sql_acct_async_t);
+
+	if (action != FR_ACTION_DONE) return;
+
+	RDEBUG("Cancelling pending SQL query");
+
+	acct_async_fd_delete(request, state);
+	fr_pool_connection_close(inst->pool, request, state->handle);
+	sql_unset_user(inst, request);
+	talloc_free(state);
+}
+
+/** Expand and send the current query, then yield until the result is available
+ *
+ */
+static rlm_rcode_t acct_async_send(REQUEST *request, sql_acct_async_t *state)
+{
+	rlm_sql_t const		*inst = state->inst;
+	char const		*value;
+	char			*expanded = NULL;
+	sql_rcode_t		sql_ret;
+
+	while (true) {
+		value = cf_pair_value(state->pair);
+		if (!value) {
+			RDEBUG("Ignoring null query");
+			return acct_async_finish(request, state, RLM_MODULE_NOOP);
+		}
+
+		if (xlat_aeval(request, &expanded, request, value, inst->sql_escape_func, state->handle) < 0) {
+			return acct_async_finish(request, state, RLM_MODULE_FAIL);
+		}
+
+		if (!*expanded) {
+			RDEBUG("Ignoring null query");
+			talloc_free(expanded);
+			return acct_async_finish(request, state, RLM_MODULE_NOOP);
+		}
+
+		rlm_sql_query_log(inst, request, state->section, expanded);
+
+		state->tries++;
+		sql_ret = rlm_sql_query_async(inst, request, &state->handle, expanded);
+		TALLOC_FREE(expanded);
+
+		switch (sql_ret) {
+		case RLM_SQL_OK:
+			break;
+
+		case RLM_SQL_QUERY_INVALID:
+			return acct_async_finish(request, state, RLM_MODULE_INVALID);
+
+		/*
+		 *  Driver found an error that hinted it might be a
+		 *  good idea to try an alternative query.
+		 */
+		case RLM_SQL_ALT_QUERY:
+			state->pair = cf_pair_find_next(state->section->cs, state->pair, state->attr);
+			if (!state->pair) {
+				RDEBUG("No additional queries configured");
+				return acct_async_finish(request, state, RLM_MODULE_NOOP);
+			}
+
+			RDEBUG("Trying next query...");
+			state->tries = 0;
+			continue;
+
+		default:
+			return acct_async_finish(request, state, RLM_MODULE_FAIL);
+		}
+
+		break;
+	}
+
+	/*
+	 *  The result may already be available, in which
+	 *  case the file descriptor won't become readable.
+	 */
+	state->sql_ret = rlm_sql_query_async_result(inst, request, state->handle);
+	if (state->sql_ret != RLM_SQL_YIELD) return acct_async_process(request, state);
+
+	state->fd = (inst->driver->sql_fd)(state->handle, inst->config);
+	if ((state->fd < 0) ||
+	    (unlang_event_fd_add(request, acct_async_read, NULL, acct_async_error, state, state->fd) < 0)) {
+		REDEBUG("Failed waiting for the result of the query");
+		state->fd = -1;
+
+		/*
+		 *  The query is still in progress, so the handle
+		 *  can't be used by anyone else.
+		 */
+		fr_pool_connection_close(inst->pool, request, state->handle);
+		state->handle = NULL;
+		return acct_async_finish(request, state, RLM_MODULE_FAIL);
+	}
+
+	return unlang_module_yield(request, acct_async_resume, acct_async_signal, state);
+}
+
 /*
  *	Generic function for failing between a bunch of queries.
  *
@@ -1503,7 +2168,7 @@ error:
  *	doesn't update any rows, the next matching config item is used.
  *
  */
-static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section)
+static int acct_redundant(rlm_sql_t const *inst, rlm_sql_thread_t *t, REQUEST *request, sql_acct_section_t *section)
 {
 	rlm_rcode_t		rcode = RLM_MODULE_OK;
 
@@ -1518,7 +2183,7 @@ static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_sect
 
 	char			path[FR_MAX_STRING_LEN];
 	char			*p = path;
-	char			*expanded = NULL;
+	sql_stmt_t		*stmt = NULL;
 
 	rad_assert(section);
 
@@ -1555,6 +2220,19 @@ static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_sect
 
 	RDEBUG2("Using query template '%s'", attr);
 
+	/*
+	 *	Queue the queries, to be written in the same
+	 *	transaction as those of other requests.  The
+	 *	queue belongs to the thread, so requests which
+	 *	don't run in a worker can't use it.
+	 */
+	if (section->batch_size && t && (request->el == t->el)) {
+		sql_set_user(inst, request, NULL);
+
+		return sql_batch_add((section == &inst->config->accounting) ? t->accounting : t->postauth,
+				     request, pair, attr);
+	}
+
 	handle = fr_pool_connection_get(inst->pool, request);
 	if (!handle) {
 		rcode = RLM_MODULE_FAIL;
@@ -1564,6 +2242,24 @@ static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_sect
 
 	sql_set_user(inst, request, NULL);
 
+	/*
+	 *	If the driver supports it, and we're running in a
+	 *	worker, yield whilst we wait for the database.
+	 */
+	if (inst->driver->sql_query_async && request->el) {
+		sql_acct_async_t *state;
+
+		MEM(state = talloc_zero(request, sql_acct_async_t));
+		state->inst = inst;
+		state->section = section;
+		state->handle = handle;
+		state->pair = pair;
+		state->attr = attr;
+		state->fd = -1;
+
+		return acct_async_send(request, state);
+	}
+
 	while (true) {
 		value = cf_pair_value(pair);
 		if (!value) {
@@ -1573,24 +2269,23 @@ static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_sect
 			goto finish;
 		}
 
-		if (xlat_aeval(request, &expanded, request, value, inst->sql_escape_func, handle) < 0) {
+		if (sql_stmt_aeval(request, &stmt, inst, request, handle, value) < 0) {
 			rcode = RLM_MODULE_FAIL;
 
 			goto finish;
 		}
 
-		if (!*expanded) {
+		if (!*stmt->query) {
 			RDEBUG("Ignoring null query");
 			rcode = RLM_MODULE_NOOP;
-			talloc_free(expanded);
 
 			goto finish;
 		}
 
-		rlm_sql_query_log(inst, request, section, expanded);
+		rlm_sql_query_log(inst, request, section, stmt->query);
 
-		sql_ret = rlm_sql_query(inst, request, &handle, expanded);
-		TALLOC_FREE(expanded);
+		sql_ret = rlm_sql_query_stmt(inst, request, &handle, stmt);
+		TALLOC_FREE(stmt);
 		RDEBUG("SQL query returned: %s", fr_int2str(sql_rcode_table, sql_ret, "<INVALID>"));
 
 		switch (sql_ret) {
@@ -1658,7 +2353,7 @@ static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_sect
 
 
 finish:
-	talloc_free(expanded);
+	talloc_free(stmt);
 	fr_pool_connection_release(inst->pool, request, handle);
 	sql_unset_user(inst, request);
 
@@ -1670,13 +2365,13 @@ finish:
 /*
  *	Accounting: Insert or update session data in our sql table
  */
-static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_accounting(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_accounting(void *instance, void *thread, REQUEST *request)
 {
 	rlm_sql_t const *inst = instance;
 
 	if (inst->config->accounting.reference_cp) {
-		return acct_redundant(inst, request, &inst->config->accounting);
+		return acct_redundant(inst, thread, request, &inst->config->accounting);
 	}
 
 	return RLM_MODULE_NOOP;
@@ -1687,13 +2382,13 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 /*
  *	Postauth: Write a record of the authentication attempt
  */
-static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_post_auth(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_post_auth(void *instance, void *thread, REQUEST *request)
 {
 	rlm_sql_t const *inst = talloc_get_type_abort(instance, rlm_sql_t);
 
 	if (inst->config->postauth.reference_cp) {
-		return acct_redundant(inst, request, &inst->config->postauth);
+		return acct_redundant(inst, thread, request, &inst->config->postauth);
 	}
 
 	return RLM_MODULE_NOOP;
@@ -1704,6 +2399,60 @@ static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *r
  */
 
 
+/** Allocate the queues for batched queries
+ *
+ * @param[in] conf	section for this instance.
+ * @param[in] instance	of rlm_sql_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return 0
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_sql_t		*inst = instance;
+	rlm_sql_thread_t	*t = thread;
+	size_t			i;
+
+	t->inst = inst;
+	t->el = el;
+
+	/*
+	 *	Let the thread keep idle connections for itself,
+	 *	if the pool allows it.
+	 */
+	MEM(t->pools = talloc_new(NULL));
+	fr_pool_thread_alloc(t->pools, inst->pool);
+	for (i = 0; i < talloc_array_length(inst->replicas); i++) {
+		fr_pool_thread_alloc(t->pools, inst->replicas[i]->pool);
+	}
+
+	if (inst->config->accounting.batch_size) {
+		t->accounting = sql_batch_alloc(NULL, inst, &inst->config->accounting, el);
+	}
+
+	if (inst->config->postauth.batch_size) {
+		t->postauth = sql_batch_alloc(NULL, inst, &inst->config->postauth, el);
+	}
+
+	return 0;
+}
+
+static int mod_thread_detach(void *thread)
+{
+	rlm_sql_thread_t	*t = thread;
+
+	TALLOC_FREE(t->accounting);
+	TALLOC_FREE(t->postauth);
+
+	/*
+	 *	After the batches, which may release connections
+	 *	when they're flushed.
+	 */
+	TALLOC_FREE(t->pools);
+
+	return 0;
+}
+
 /* globally exported name */
 rad_module_t rlm_sql = {
 	.magic		= RLM_MODULE_INIT,
@@ -1714,6 +2463,9 @@ rad_module_t rlm_sql = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_sql_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 #ifdef WITH_ACCOUNTING
@@ -51,6 +51,8 @@ typedef enum {
 	RLM_SQL_RECONNECT = 1,		//!< Stale connection, should reconnect.
 	RLM_SQL_ALT_QUERY,		//!< Key constraint violation, use an alternative query.
 	RLM_SQL_NO_MORE_ROWS,		//!< No more rows available
+	RLM_SQL_YIELD,			//!< Result not yet available, wait for the
+					//!< connection's file descriptor to become readable.
 } sql_rcode_t;
 
 typedef enum {
@@ -81,6 +83,11 @@ typedef struct sql_acct_section {
 
 	char const		*logfile;
 
+	uint32_t		batch_size;			//!< Maximum number of requests whose queries
+								//!< are written in one transaction.
+	struct timeval		batch_timeout;			//!< Maximum time a request waits for the
+								//!< rest of its batch.
+
 	char const		**query;			/* for xlat parsing */
 } sql_acct_section_t;
 
@@ -102,6 +109,9 @@ typedef struct sql_config {
 
 	char const		*client_query;			//!< Query used to get FreeRADIUS client
 								//!< definitions.
+	char const		*client_refresh_query;		//!< Query used to get clients which have
+								//!< changed since the last refresh.
+	uint32_t		client_refresh_interval;	//!< How often to refresh clients.
 
 	char const		*authorize_check_query;		//!< Query used get check VPs for a user.
 	char const 		*authorize_reply_query;		//!< Query used get reply VPs for a user.
@@ -110,6 +120,8 @@ typedef struct sql_config {
 	char const 		*groupmemb_query;		//!< Query to determine group membership.
 
 	bool			do_clients;			//!< Read clients from SQL database.
+	bool			do_clients_background;		//!< Read clients after the server has
+								//!< started.
 	bool			read_groups;			//!< Read user groups by default.
 								//!< If false, Fall-Through = yes is required
 								//!< in the previous reply list to process
@@ -124,6 +136,16 @@ typedef struct sql_config {
 
 	char const		*allowed_chars;			//!< Chars which done need escaping..
 	uint32_t		query_timeout;			//!< How long to allow queries to run for.
+	uint32_t		map_cache_lifetime;		//!< How long identical map queries share
+								//!< a result set.
+	bool			prepared_statements;		//!< Execute accounting and post-auth queries
+								//!< as prepared statements, where possible.
+
+	char const		*replica_lag_query;		//!< Query returning how many seconds a
+								//!< replica is behind the primary.
+	uint32_t		replica_max_lag;		//!< Stop reading from replicas which are
+								//!< further behind than this.
+	uint32_t		replica_check_interval;		//!< How often to check replica lag.
 
 	char const		*connect_query;			//!< Query executed after establishing
 								//!< new connection.
@@ -144,11 +166,16 @@ typedef struct sql_config {
 } rlm_sql_config_t;
 
 typedef struct sql_inst rlm_sql_t;
+typedef struct sql_replica rlm_sql_replica_t;
 
 typedef struct rlm_sql_handle {
 	void			*conn;				//!< Database specific connection handle.
 	rlm_sql_row_t		row;				//!< Row data from the last query.
+	fr_value_box_t		*boxes;				//!< Boxes wrapping row, for drivers without
+								//!< sql_fetch_row_boxed.
 	rlm_sql_t const		*inst;				//!< The rlm_sql instance this connection belongs to.
+	rlm_sql_replica_t	*replica;			//!< Replica this connection is to, NULL if it's
+								//!< to the primary.
 	TALLOC_CTX		*log_ctx;			//!< Talloc pool used to avoid allocing memory
 								//!< when log strings need to be copied.
 } rlm_sql_handle_t;
@@ -159,6 +186,30 @@ extern const FR_NAME_NUMBER sql_rcode_table[];
  */
 #define RLM_SQL_RCODE_FLAGS_ALT_QUERY	1			//!< Can distinguish between other errors and those
 								//!< resulting from a unique key violation.
+#define RLM_SQL_PARAM_FLAGS_NUMBERED	2			//!< Placeholders for bound parameters are $1, $2...
+								//!< rather than ?.
+
+/** A value to bind to a placeholder in a prepared statement
+ *
+ */
+typedef struct {
+	char const		*value;				//!< Unescaped value.
+	size_t			length;				//!< Length of the value.
+	bool			numeric;			//!< The value is a number, used outside of a
+								//!< string literal, and may be bound as one.
+} sql_param_t;
+
+/** An expanded query, and the prepared statement it may be executed as
+ *
+ */
+typedef struct {
+	char const		*query;				//!< The query, with every value escaped.
+	char const		*prepared;			//!< The query, with placeholders for the values.
+								//!< NULL if it can't be executed as a prepared
+								//!< statement.
+	sql_param_t		*params;			//!< Values to bind to the placeholders.
+	int			num_params;			//!< Number of placeholders.
+} sql_stmt_t;
 
 /** Retrieve errors from the last query operation
  *
@@ -210,6 +261,50 @@ typedef struct rlm_sql_driver_t {
 	sql_rcode_t (*sql_finish_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 
 	xlat_escape_t	sql_escape_func;
+
+	/*
+	 *	Optional asynchronous interface.  Drivers which provide
+	 *	these allow queries to be run without blocking the
+	 *	worker thread.
+	 *
+	 *	sql_query_async sends the query, and must not wait for
+	 *	the result.  sql_query_async_result is then called each
+	 *	time the file descriptor returned by sql_fd becomes
+	 *	readable, and returns #RLM_SQL_YIELD until the result is
+	 *	available.  Its other return codes, and how the result is
+	 *	retrieved, are the same as for sql_query.
+	 */
+	sql_rcode_t (*sql_query_async)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query);
+	sql_rcode_t (*sql_query_async_result)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
+	int (*sql_fd)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
+
+	/*
+	 *	Optional prepared statement interface.
+	 *
+	 *	sql_query_prepared executes a query with placeholders,
+	 *	binding params to them.  The driver should keep the
+	 *	statements it prepares with the connection, and reuse
+	 *	them when called with the same query.  Return codes,
+	 *	and how the result is retrieved, are the same as for
+	 *	sql_query.
+	 */
+	sql_rcode_t (*sql_query_prepared)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query,
+					  sql_param_t const *params, int num_params);
+
+	/*
+	 *	Optional typed row interface.
+	 *
+	 *	sql_fetch_row_boxed fetches the next row as a talloced
+	 *	array of value boxes, one per field, in the field's
+	 *	native type where the driver knows it.  The boxes should
+	 *	point into the driver's own result buffers, and only need
+	 *	to be valid until the next row is fetched, or the result
+	 *	is freed.  Strings must be \0 terminated.  NULL fields
+	 *	have type FR_TYPE_INVALID.  Return codes are the same as
+	 *	for sql_fetch_row.
+	 */
+	sql_rcode_t (*sql_fetch_row_boxed)(fr_value_box_t const **out, rlm_sql_handle_t *handle,
+					   rlm_sql_config_t *config);
 } rlm_sql_driver_t;
 
 struct sql_inst {
@@ -233,15 +328,63 @@ struct sql_inst {
 
 	char const		*name;			//!< Module instance name.
 	fr_dict_attr_t const	*group_da;		//!< Group dictionary attribute.
+
+	rbtree_t		*map_cache;		//!< Recent map result sets, keyed by query.
+	pthread_mutex_t		map_cache_mutex;	//!< Protects the map cache.
+
+	rlm_sql_replica_t	**replicas;		//!< Read only servers, used for SELECTs.
+
+	pthread_t		clients_thread;		//!< Reads and refreshes clients.
+	bool			clients_running;	//!< Whether clients_thread was started.
+	bool			clients_stop;		//!< Tells clients_thread to exit.
+	pthread_mutex_t		clients_mutex;		//!< Protects clients_stop.
+	pthread_cond_t		clients_cond;		//!< Signalled when clients_stop is set.
+};
+
+/** A read only server
+ *
+ * Has its own connection pool, and a copy of the module's configuration
+ * with the connection details from its "replica" section.
+ */
+struct sql_replica {
+	char const		*name;			//!< Name of the replica section, or the server.
+	rlm_sql_t		*inst;			//!< The rlm_sql instance the replica belongs to.
+	CONF_SECTION		*cs;			//!< The replica's configuration section.
+	rlm_sql_config_t	config;			//!< Configuration used to connect to the replica.
+	fr_pool_t		*pool;			//!< Connections to the replica.
+
+	pthread_mutex_t		mutex;			//!< Protects next_check.
+	time_t			next_check;		//!< When the lag should next be checked.
+	bool			lagging;		//!< Was too far behind when last checked.
 };
 
+typedef struct sql_batch sql_batch_t;
+
+/** Thread specific instance data
+ *
+ */
+typedef struct {
+	rlm_sql_t const		*inst;				//!< Module instance.
+	fr_event_list_t		*el;				//!< The event list serviced by this thread.
+
+	sql_batch_t		*accounting;			//!< Queued accounting queries.
+	sql_batch_t		*postauth;			//!< Queued post-auth queries.
+
+	TALLOC_CTX		*pools;				//!< Connections owned by this thread.
+} rlm_sql_thread_t;
+
 typedef struct sql_grouplist {
 	char			*name;
 	struct sql_grouplist	*next;
 } rlm_sql_grouplist_t;
 
 void		*mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout);
-int		sql_fr_pair_list_afrom_str(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **first_pair, rlm_sql_row_t row);
+void		*mod_replica_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout);
+rlm_sql_handle_t *sql_read_handle_get(rlm_sql_t const *inst, REQUEST *request);
+void		sql_handle_release(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle);
+int		sql_pair_value_from_box(VALUE_PAIR *vp, fr_value_box_t const *value);
+int		sql_fr_pair_list_afrom_boxes(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **head,
+					     fr_value_box_t const *row, int num_fields);
 int		sql_read_realms(rlm_sql_handle_t *handle);
 int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, VALUE_PAIR **pair, char const *query);
 int		sql_read_clients(rlm_sql_handle_t *handle);
@@ -249,7 +392,24 @@ int		sql_dict_init(rlm_sql_handle_t *handle);
 void 		rlm_sql_query_log(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section, char const *query) CC_HINT(nonnull (1, 2, 4));
 sql_rcode_t	rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
 sql_rcode_t	rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
+sql_rcode_t	rlm_sql_query_once(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, char const *query) CC_HINT(nonnull);
+int		sql_stmt_aeval(TALLOC_CTX *ctx, sql_stmt_t **out, rlm_sql_t const *inst, REQUEST *request,
+			       rlm_sql_handle_t *handle, char const *fmt) CC_HINT(nonnull);
+sql_rcode_t	rlm_sql_query_stmt(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, sql_stmt_t const *stmt) CC_HINT(nonnull (1, 3, 4));
+sql_rcode_t	rlm_sql_query_stmt_once(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, sql_stmt_t const *stmt) CC_HINT(nonnull);
+sql_rcode_t	rlm_sql_query_async(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 2, 3, 4));
+sql_rcode_t	rlm_sql_query_async_result(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle) CC_HINT(nonnull);
 int		rlm_sql_fetch_row(rlm_sql_row_t *out, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle);
+sql_rcode_t	rlm_sql_fetch_row_boxed(fr_value_box_t const **out, rlm_sql_t const *inst, REQUEST *request,
+					rlm_sql_handle_t **handle);
 void		rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, bool force_debug);
 int		sql_set_user(rlm_sql_t const *inst, REQUEST *request, char const *username);
+#define		sql_unset_user(_i, _r) fr_pair_delete_by_num(&_r->packet->vps, _i->sql_user->vendor, _i->sql_user->attr, TAG_ANY)
+
+/*
+ *	batch.c
+ */
+sql_batch_t	*sql_batch_alloc(TALLOC_CTX *ctx, rlm_sql_t const *inst, sql_acct_section_t *section,
+				 fr_event_list_t *el);
+rlm_rcode_t	sql_batch_add(sql_batch_t *batch, REQUEST *request, CONF_PAIR *pair, char const *attr);
 #endif
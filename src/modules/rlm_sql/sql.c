@@ -50,13 +50,14 @@ const FR_NAME_NUMBER sql_rcode_table[] = {
 	{ "query invalid",	RLM_SQL_QUERY_INVALID	},
 	{ "no connection",	RLM_SQL_RECONNECT	},
 	{ "no more rows",	RLM_SQL_NO_MORE_ROWS	},
+	{ "waiting",		RLM_SQL_YIELD		},
 	{ NULL, 0 }
 };
 
-void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout)
+static rlm_sql_handle_t *sql_conn_create(TALLOC_CTX *ctx, rlm_sql_t *inst, rlm_sql_replica_t *replica,
+					 struct timeval const *timeout)
 {
 	int rcode;
-	rlm_sql_t *inst = instance;
 	rlm_sql_handle_t *handle;
 
 	/*
@@ -77,8 +78,9 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *tim
 	 *	destructor has access to the module configuration.
 	 */
 	handle->inst = inst;
+	handle->replica = replica;
 
-	rcode = (inst->driver->sql_socket_init)(handle, inst->config, timeout);
+	rcode = (inst->driver->sql_socket_init)(handle, replica ? &replica->config : inst->config, timeout);
 	if (rcode != 0) {
 	fail:
 		/*
@@ -96,37 +98,268 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *tim
 	return handle;
 }
 
-/*************************************************************************
+void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout)
+{
+	return sql_conn_create(ctx, instance, NULL, timeout);
+}
+
+/** Create a connection to a replica
  *
- *	Function: sql_fr_pair_list_afrom_str
+ * @param[in] ctx	to allocate the handle in.
+ * @param[in] instance	#rlm_sql_replica_t to connect to.
+ * @param[in] timeout	for establishing the connection.
+ */
+void *mod_replica_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout)
+{
+	rlm_sql_replica_t *replica = instance;
+
+	return sql_conn_create(ctx, replica->inst, replica, timeout);
+}
+
+/** Return the pool a connection was reserved from
  *
- *	Purpose: Read entries from the database and fill VALUE_PAIR structures
+ */
+static inline fr_pool_t *sql_handle_pool(rlm_sql_t const *inst, rlm_sql_handle_t const *handle)
+{
+	return handle->replica ? handle->replica->pool : inst->pool;
+}
+
+/** Check whether a replica is too far behind the primary
  *
- *************************************************************************/
-int sql_fr_pair_list_afrom_str(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **head, rlm_sql_row_t row)
+ * Runs replica_lag_query at most once every replica_check_interval,
+ * and records the result for other requests to use until the next
+ * check.  A replica where the query fails is treated as lagging.
+ *
+ * @return
+ *	- true if the replica should be skipped.
+ *	- false if it can be used.
+ */
+static bool sql_replica_lagging(rlm_sql_t const *inst, REQUEST *request, rlm_sql_replica_t *replica,
+				rlm_sql_handle_t **handle)
+{
+	time_t		now;
+	rlm_sql_row_t	row;
+	bool		lagging = true;
+	unsigned long	lag = 0;
+
+	if (!inst->config->replica_max_lag || !inst->config->replica_lag_query) return false;
+
+	now = time(NULL);
+
+	pthread_mutex_lock(&replica->mutex);
+	if (now < replica->next_check) {
+		pthread_mutex_unlock(&replica->mutex);
+		return replica->lagging;
+	}
+	replica->next_check = now + inst->config->replica_check_interval;
+	pthread_mutex_unlock(&replica->mutex);
+
+	if (rlm_sql_select_query(inst, request, handle, inst->config->replica_lag_query) == RLM_SQL_OK) {
+		if ((rlm_sql_fetch_row(&row, inst, request, handle) == RLM_SQL_OK) && row[0]) {
+			lag = strtoul(row[0], NULL, 10);
+			lagging = (lag > inst->config->replica_max_lag);
+		}
+		(inst->driver->sql_finish_select_query)(*handle, inst->config);
+	}
+
+	if (lagging != replica->lagging) {
+		if (lagging) {
+			WARN("Replica \"%s\" is %lus behind the primary, or its lag couldn't be determined.  "
+			     "Not using it for %us", replica->name, lag, inst->config->replica_check_interval);
+		} else {
+			INFO("Replica \"%s\" has caught up with the primary", replica->name);
+		}
+	}
+	replica->lagging = lagging;
+
+	return lagging;
+}
+
+/** Reserve a connection for a read only query
+ *
+ * Replicas are tried in turn, starting with a different one for each
+ * request.  A replica is skipped if no connection to it can be
+ * reserved, or it's too far behind the primary.  If every replica is
+ * skipped, a connection to the primary is reserved instead.
+ *
+ * @param[in] inst	Instance of #rlm_sql_t.
+ * @param[in] request	The current request, may be NULL.
+ * @return
+ *	- A connection, to be released with #sql_handle_release.
+ *	- NULL if no connection could be reserved.
+ */
+rlm_sql_handle_t *sql_read_handle_get(rlm_sql_t const *inst, REQUEST *request)
+{
+	size_t			i, num = talloc_array_length(inst->replicas);
+	size_t			start = request ? request->number : 0;
+	rlm_sql_handle_t	*handle;
+
+	for (i = 0; i < num; i++) {
+		rlm_sql_replica_t *replica = inst->replicas[(start + i) % num];
+
+		if (replica->lagging && (time(NULL) < replica->next_check)) continue;
+
+		handle = fr_pool_connection_get(replica->pool, request);
+		if (!handle) continue;
+
+		if (sql_replica_lagging(inst, request, replica, &handle)) {
+			if (handle) fr_pool_connection_release(replica->pool, request, handle);
+			continue;
+		}
+
+		/*
+		 *	The lag check may have had to
+		 *	reconnect, and failed.
+		 */
+		if (!handle) continue;
+
+		ROPTIONAL(RDEBUG3, DEBUG3, "Using replica \"%s\"", replica->name);
+
+		return handle;
+	}
+
+	if (num) ROPTIONAL(RDEBUG2, DEBUG2, "No replicas available, using the primary");
+
+	return fr_pool_connection_get(inst->pool, request);
+}
+
+/** Release a connection reserved with #sql_read_handle_get, or from the primary's pool
+ *
+ */
+void sql_handle_release(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle)
 {
-	VALUE_PAIR *vp;
-	char const *ptr, *value;
-	char buf[FR_MAX_STRING_LEN];
-	char do_xlat = 0;
-	FR_TOKEN token, op = T_EOL;
+	if (!handle) return;
+
+	fr_pool_connection_release(sql_handle_pool(inst, handle), request, handle);
+}
+
+/** Set the value of a pair from a field of a result set
+ *
+ * Strings are parsed as if they came from a double quoted string.
+ * Integers and floats are assigned directly where the attribute
+ * is of a compatible type, and printed and parsed otherwise.
+ *
+ * @param[in] vp	to set the value of.
+ * @param[in] value	of the field.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sql_pair_value_from_box(VALUE_PAIR *vp, fr_value_box_t const *value)
+{
+	char buffer[64];
+
+	switch (value->type) {
+	case FR_TYPE_STRING:
+		return fr_pair_value_from_str(vp, value->vb_strvalue, value->datum.length);
+
+	case FR_TYPE_OCTETS:
+		if (vp->vp_type == FR_TYPE_OCTETS) {
+			fr_pair_value_memcpy(vp, value->vb_octets, value->datum.length);
+			return 0;
+		}
+		return fr_pair_value_from_str(vp, (char const *)value->vb_octets, value->datum.length);
+
+	case FR_TYPE_INT64:
+		switch (vp->vp_type) {
+		case FR_TYPE_UINT32:
+			if ((value->vb_int64 < 0) || (value->vb_int64 > UINT32_MAX)) break;
+			vp->vp_uint32 = value->vb_int64;
+			goto done;
+
+		case FR_TYPE_UINT64:
+			if (value->vb_int64 < 0) break;
+			vp->vp_uint64 = value->vb_int64;
+			goto done;
+
+		case FR_TYPE_INT32:
+			if ((value->vb_int64 < INT32_MIN) || (value->vb_int64 > INT32_MAX)) break;
+			vp->vp_int32 = value->vb_int64;
+			goto done;
+
+		case FR_TYPE_INT64:
+			vp->vp_int64 = value->vb_int64;
+			goto done;
+
+		default:
+			break;
+		}
+
+		/*
+		 *	Let the parser deal with enumerated
+		 *	values, dates, and out of range errors.
+		 */
+		snprintf(buffer, sizeof(buffer), "%" PRId64, value->vb_int64);
+		return fr_pair_value_from_str(vp, buffer, strlen(buffer));
+
+	case FR_TYPE_FLOAT64:
+		if (vp->vp_type == FR_TYPE_FLOAT64) {
+			vp->vp_float64 = value->vb_float64;
+			goto done;
+		}
+
+		snprintf(buffer, sizeof(buffer), "%f", value->vb_float64);
+		return fr_pair_value_from_str(vp, buffer, strlen(buffer));
+
+	default:
+		fr_strerror_printf("Can't convert %s field to %s",
+				   fr_int2str(dict_attr_types, value->type, "<INVALID>"),
+				   fr_int2str(dict_attr_types, vp->vp_type, "<INVALID>"));
+		return -1;
+	}
+
+done:
+	vp->type = VT_DATA;
+
+	return 0;
+}
+
+/** Convert a row of a radcheck or radreply style result set to a VALUE_PAIR
+ *
+ * Fields are id, username, attribute, value, op.
+ *
+ * @param[in] ctx		to allocate the pair in.
+ * @param[in] request		The current request.
+ * @param[in,out] head		List to add the pair to.
+ * @param[in] row		Fields returned by #rlm_sql_fetch_row_boxed.
+ * @param[in] num_fields	in the row.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sql_fr_pair_list_afrom_boxes(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **head,
+				 fr_value_box_t const *row, int num_fields)
+{
+	VALUE_PAIR		*vp;
+	char const		*ptr, *attr;
+	char			buf[FR_MAX_STRING_LEN];
+	bool			do_xlat = false;
+	FR_TOKEN		token, op = T_EOL;
+	fr_value_box_t const	*value;
+	fr_value_box_t		unquoted;
+
+	if (num_fields < 5) {
+		REDEBUG("Query returned %i fields, expected at least 5", num_fields);
+		return -1;
+	}
 
 	/*
 	 *	Verify the 'Attribute' field
 	 */
-	if (!row[2] || row[2][0] == '\0') {
+	if ((row[2].type != FR_TYPE_STRING) || (row[2].vb_strvalue[0] == '\0')) {
 		REDEBUG("Attribute field is empty or NULL, skipping the entire row");
 		return -1;
 	}
+	attr = row[2].vb_strvalue;
 
 	/*
 	 *	Verify the 'op' field
 	 */
-	if (row[4] != NULL && row[4][0] != '\0') {
-		ptr = row[4];
+	if ((row[4].type == FR_TYPE_STRING) && (row[4].vb_strvalue[0] != '\0')) {
+		ptr = row[4].vb_strvalue;
 		op = gettoken(&ptr, buf, sizeof(buf), false);
 		if (!fr_assignment_op[op] && !fr_equality_op[op]) {
-			REDEBUG("Invalid op \"%s\" for attribute %s", row[4], row[2]);
+			REDEBUG("Invalid op \"%s\" for attribute %s", row[4].vb_strvalue, attr);
 			return -1;
 		}
 
@@ -135,51 +368,54 @@ int sql_fr_pair_list_afrom_str(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **h
 		 *  Complain about empty or invalid 'op' field
 		 */
 		op = T_OP_CMP_EQ;
-		REDEBUG("The op field for attribute '%s = %s' is NULL, or non-existent.", row[2], row[3]);
+		REDEBUG("The op field for attribute '%s' is NULL, or non-existent.", attr);
 		REDEBUG("You MUST FIX THIS if you want the configuration to behave as you expect");
 	}
 
 	/*
 	 *	The 'Value' field may be empty or NULL
 	 */
-	if (!row[3]) {
+	if (row[3].type == FR_TYPE_INVALID) {
 		REDEBUG("Value field is empty or NULL, skipping the entire row");
 		return -1;
 	}
 
-	value = row[3];
+	value = &row[3];
 
 	/*
 	 *	If we have a new-style quoted string, where the
 	 *	*entire* string is quoted, do xlat's.
 	 */
-	if (row[3] != NULL &&
-	   ((row[3][0] == '\'') || (row[3][0] == '`') || (row[3][0] == '"')) &&
-	   (row[3][0] == row[3][strlen(row[3])-1])) {
+	if ((value->type == FR_TYPE_STRING) && (value->datum.length > 0) &&
+	    ((value->vb_strvalue[0] == '\'') || (value->vb_strvalue[0] == '`') || (value->vb_strvalue[0] == '"')) &&
+	    (value->vb_strvalue[0] == value->vb_strvalue[value->datum.length - 1])) {
+		ptr = value->vb_strvalue;
 
-		token = gettoken(&value, buf, sizeof(buf), false);
+		token = gettoken(&ptr, buf, sizeof(buf), false);
 		switch (token) {
 		/*
 		 *	Take the unquoted string.
 		 */
 		case T_SINGLE_QUOTED_STRING:
 		case T_DOUBLE_QUOTED_STRING:
-			value = buf;
+			memset(&unquoted, 0, sizeof(unquoted));
+			unquoted.type = FR_TYPE_STRING;
+			unquoted.vb_strvalue = buf;
+			unquoted.datum.length = strlen(buf);
+			value = &unquoted;
 			break;
 
 		/*
 		 *	Mark the pair to be allocated later.
 		 */
 		case T_BACK_QUOTED_STRING:
-			do_xlat = 1;
-
-			/* FALL-THROUGH */
+			do_xlat = true;
+			break;
 
 		/*
 		 *	Keep the original string.
 		 */
 		default:
-			value = row[3];
 			break;
 		}
 	}
@@ -187,21 +423,21 @@ int sql_fr_pair_list_afrom_str(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **h
 	/*
 	 *	Create the pair
 	 */
-	vp = fr_pair_make(ctx, NULL, row[2], NULL, op);
+	vp = fr_pair_make(ctx, NULL, attr, NULL, op);
 	if (!vp) {
 		RPEDEBUG("Failed to create the pair");
 		return -1;
 	}
 
 	if (do_xlat) {
-		if (fr_pair_mark_xlat(vp, value) < 0) {
+		if (fr_pair_mark_xlat(vp, value->vb_strvalue) < 0) {
 			RPEDEBUG("Error marking pair for xlat");
 
 			talloc_free(vp);
 			return -1;
 		}
 	} else {
-		if (fr_pair_value_from_str(vp, value, -1) < 0) {
+		if (sql_pair_value_from_box(vp, value) < 0) {
 			RPEDEBUG("Error parsing value");
 
 			talloc_free(vp);
@@ -257,6 +493,79 @@ sql_rcode_t rlm_sql_fetch_row(rlm_sql_row_t *out, rlm_sql_t const *inst, REQUEST
 	}
 }
 
+/** Fetch the next row as an array of value boxes
+ *
+ * Uses the driver's sql_fetch_row_boxed function if it has one, so
+ * fields are returned in their native types, without being copied.
+ * Otherwise the text row is wrapped in string boxes.
+ *
+ * The boxes are only valid until the next row is fetched, or the
+ * query is finished.  Their buffers may not be talloced, so they
+ * must be copied, not stolen or referenced.  NULL fields have
+ * type #FR_TYPE_INVALID.
+ *
+ * @param[out] out		Where to write the array of boxes, one per field.
+ *				Use talloc_array_length() to get the number of fields.
+ * @param[in] inst		Instance of #rlm_sql_t.
+ * @param[in] request		The Current request, may be NULL.
+ * @param[in] handle		Handle to retrieve errors for.
+ * @return as #rlm_sql_fetch_row.
+ */
+sql_rcode_t rlm_sql_fetch_row_boxed(fr_value_box_t const **out, rlm_sql_t const *inst, REQUEST *request,
+				    rlm_sql_handle_t **handle)
+{
+	rlm_sql_row_t	row;
+	sql_rcode_t	ret;
+	int		i, num_fields;
+
+	*out = NULL;
+
+	if (!*handle || !(*handle)->conn) return RLM_SQL_ERROR;
+
+	if (inst->driver->sql_fetch_row_boxed) {
+		ret = (inst->driver->sql_fetch_row_boxed)(out, *handle, inst->config);
+		switch (ret) {
+		case RLM_SQL_OK:
+			rad_assert(*out != NULL);
+			return ret;
+
+		case RLM_SQL_NO_MORE_ROWS:
+			rad_assert(*out == NULL);
+			return ret;
+
+		default:
+			ROPTIONAL(RERROR, ERROR, "Error fetching row");
+			rlm_sql_print_error(inst, request, *handle, false);
+			return ret;
+		}
+	}
+
+	ret = rlm_sql_fetch_row(&row, inst, request, handle);
+	if (ret != RLM_SQL_OK) return ret;
+
+	num_fields = (inst->driver->sql_num_fields)(*handle, inst->config);
+	if (num_fields < 0) num_fields = 0;
+
+	if (!(*handle)->boxes || (talloc_array_length((*handle)->boxes) != (size_t)num_fields)) {
+		talloc_free((*handle)->boxes);
+		MEM((*handle)->boxes = talloc_array(*handle, fr_value_box_t, num_fields));
+	}
+
+	for (i = 0; i < num_fields; i++) {
+		fr_value_box_t *value = &(*handle)->boxes[i];
+
+		memset(value, 0, sizeof(*value));
+		if (!row[i]) continue;
+
+		value->type = FR_TYPE_STRING;
+		value->vb_strvalue = row[i];
+		value->datum.length = strlen(row[i]);
+	}
+	*out = (*handle)->boxes;
+
+	return RLM_SQL_OK;
+}
+
 /** Retrieve any errors from the SQL driver
  *
  * Retrieves errors from the driver from the last operation and writes them to
@@ -308,6 +617,299 @@ void rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle
 	talloc_free_children(handle->log_ctx);
 }
 
+/** Log any errors from a failed query, and rewrite the driver's return code
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle the query was executed with.
+ * @param ret returned by the driver.
+ * @return
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ *	- #RLM_SQL_ALT_QUERY on constraints violation, or if the driver can't tell
+ *	  constraints violations apart from other errors.
+ *	- ret for any other return code.
+ */
+static sql_rcode_t sql_query_rcode(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle,
+				   sql_rcode_t ret)
+{
+	switch (ret) {
+	/*
+	 *	These are bad and should make rlm_sql return invalid
+	 */
+	case RLM_SQL_QUERY_INVALID:
+		rlm_sql_print_error(inst, request, handle, false);
+		(inst->driver->sql_finish_query)(handle, inst->config);
+		break;
+
+	/*
+	 *	Server or client errors.
+	 *
+	 *	If the driver claims to be able to distinguish between
+	 *	duplicate row errors and other errors, and we hit a
+	 *	general error treat it as a failure.
+	 *
+	 *	Otherwise rewrite it to RLM_SQL_ALT_QUERY.
+	 */
+	case RLM_SQL_ERROR:
+		if (inst->driver->flags & RLM_SQL_RCODE_FLAGS_ALT_QUERY) {
+			rlm_sql_print_error(inst, request, handle, false);
+			(inst->driver->sql_finish_query)(handle, inst->config);
+			break;
+		}
+		ret = RLM_SQL_ALT_QUERY;
+		/* FALL-THROUGH */
+
+	/*
+	 *	Driver suggested using an alternative query
+	 */
+	case RLM_SQL_ALT_QUERY:
+		rlm_sql_print_error(inst, request, handle, true);
+		(inst->driver->sql_finish_query)(handle, inst->config);
+		break;
+
+	default:
+		break;
+	}
+
+	return ret;
+}
+
+/** Context for sql_stmt_escape
+ *
+ */
+typedef struct {
+	rlm_sql_t const		*inst;
+	rlm_sql_handle_t	*handle;	//!< To escape values with, if they can't be bound.
+	char			**values;	//!< Unescaped values of the expansions.
+	int			count;		//!< Number of values.
+	bool			unprepared;	//!< Some values were escaped and written inline.
+} sql_stmt_ctx_t;
+
+#define SQL_STMT_MARKER_START	'\001'
+#define SQL_STMT_MARKER_END	'\002'
+#define SQL_STMT_MAX_PARAMS	100
+
+/** Parse a marker written by sql_stmt_escape
+ *
+ * @return the index of the value, or -1 if p doesn't point to a marker.
+ */
+static int sql_stmt_marker(sql_stmt_ctx_t const *sctx, char const *p, char const **end)
+{
+	unsigned long	idx;
+	char		*q;
+
+	if ((p[0] != SQL_STMT_MARKER_START) || !isdigit((uint8_t) p[1])) return -1;
+
+	idx = strtoul(p + 1, &q, 10);
+	if ((*q != SQL_STMT_MARKER_END) || (idx >= (unsigned long) sctx->count)) return -1;
+
+	*end = q + 1;
+	return idx;
+}
+
+/** Record the value of an expansion, and replace it with a marker
+ *
+ * Once the whole query has been expanded, the markers are
+ * replaced by placeholders, or by the escaped values.
+ */
+static size_t sql_stmt_escape(REQUEST *request, char *out, size_t outlen, char const *in, void *arg)
+{
+	sql_stmt_ctx_t	*sctx = arg;
+	rlm_sql_t const	*inst = sctx->inst;
+	char const	*end;
+
+	/*
+	 *	Values of alternations are escaped twice.
+	 */
+	if ((sql_stmt_marker(sctx, in, &end) >= 0) && !*end) {
+		strlcpy(out, in, outlen);
+		return strlen(out);
+	}
+
+	if (sctx->count >= SQL_STMT_MAX_PARAMS) {
+		sctx->unprepared = true;
+		return inst->sql_escape_func(request, out, outlen, in, sctx->handle);
+	}
+
+	if (!sctx->values) {
+		MEM(sctx->values = talloc_array(NULL, char *, SQL_STMT_MAX_PARAMS));
+	}
+	MEM(sctx->values[sctx->count] = talloc_typed_strdup(sctx->values, in));
+
+	return snprintf(out, outlen, "%c%i%c", SQL_STMT_MARKER_START, sctx->count++, SQL_STMT_MARKER_END);
+}
+
+/** Whether a value can be bound to a placeholder in numeric context
+ *
+ */
+static bool sql_stmt_is_number(char const *value)
+{
+	char const *p = value;
+
+	if (*p == '-') p++;
+	if (!isdigit((uint8_t) *p)) return false;
+	while (isdigit((uint8_t) *p)) p++;
+
+	if (*p == '.') {
+		p++;
+		if (!isdigit((uint8_t) *p)) return false;
+		while (isdigit((uint8_t) *p)) p++;
+	}
+
+	return (*p == '\0');
+}
+
+/** Expand a query, noting which values can be passed as bound parameters
+ *
+ * A value can be bound if it's the whole of a string literal, e.g.
+ * ``'%{User-Name}'``, or if it's a number outside of a string literal.
+ * If every value in the query can be bound, the query is also written
+ * with placeholders in place of the values, so the driver can prepare
+ * it once per connection, and reuse it for every request.
+ *
+ * Otherwise, or if the driver doesn't support prepared statements, the
+ * query is executed as text, with every value escaped.
+ *
+ * @param[in] ctx	to allocate the statement in.
+ * @param[out] out	The expanded statement.
+ * @param[in] inst	#rlm_sql_t instance data.
+ * @param[in] request	Current request.
+ * @param[in] handle	to escape values with.
+ * @param[in] fmt	of the query.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the query couldn't be expanded.
+ */
+int sql_stmt_aeval(TALLOC_CTX *ctx, sql_stmt_t **out, rlm_sql_t const *inst, REQUEST *request,
+		   rlm_sql_handle_t *handle, char const *fmt)
+{
+	sql_stmt_t	*stmt;
+	sql_stmt_ctx_t	sctx;
+	char		*raw = NULL, *query, *prepared = NULL, *escaped;
+	char const	*p, *end, *marker, *quote = NULL;
+	bool		in_ident = false;
+	size_t		len;
+	int		idx;
+
+	MEM(stmt = talloc_zero(ctx, sql_stmt_t));
+	*out = NULL;
+
+	if (!inst->driver->sql_query_prepared || !inst->config->prepared_statements) {
+		char *expanded = NULL;
+
+		if (xlat_aeval(stmt, &expanded, request, fmt, inst->sql_escape_func, handle) < 0) {
+			talloc_free(stmt);
+			return -1;
+		}
+		stmt->query = expanded;
+		*out = stmt;
+		return 0;
+	}
+
+	memset(&sctx, 0, sizeof(sctx));
+	sctx.inst = inst;
+	sctx.handle = handle;
+
+	if (xlat_aeval(stmt, &raw, request, fmt, sql_stmt_escape, &sctx) < 0) {
+		talloc_free(sctx.values);
+		talloc_free(stmt);
+		return -1;
+	}
+
+	MEM(query = talloc_strdup(stmt, ""));
+	if (!sctx.unprepared) {
+		MEM(prepared = talloc_strdup(stmt, ""));
+		if (sctx.count) MEM(stmt->params = talloc_array(stmt, sql_param_t, sctx.count));
+	}
+
+	p = raw;
+	while (*p) {
+		idx = sql_stmt_marker(&sctx, p, &end);
+		if (idx < 0) {
+			/*
+			 *	Track whether we're in a string literal,
+			 *	or a quoted identifier.
+			 */
+			if ((*p == '\'') && !in_ident) {
+				quote = quote ? NULL : p;
+			} else if ((*p == '"') && !quote) {
+				in_ident = !in_ident;
+			}
+
+			MEM(query = talloc_strndup_append(query, p, 1));
+			if (prepared) MEM(prepared = talloc_strndup_append(prepared, p, 1));
+			p++;
+			continue;
+		}
+
+		marker = p;
+		len = talloc_array_length(sctx.values[idx]) * 3;
+		MEM(escaped = talloc_array(stmt, char, len));
+		inst->sql_escape_func(request, escaped, len, sctx.values[idx], handle);
+		MEM(query = talloc_strdup_append_buffer(query, escaped));
+		talloc_free(escaped);
+
+		p = end;
+		if (!prepared) continue;
+
+		/*
+		 *	The value is the whole of a string literal,
+		 *	so replace the literal with a placeholder.
+		 */
+		if (quote && ((quote + 1) == marker) && (*p == '\'') && (p[1] != '\'')) {
+			prepared[strlen(prepared) - 1] = '\0';
+			MEM(query = talloc_strndup_append(query, p, 1));
+			quote = NULL;
+			p++;
+
+			stmt->params[stmt->num_params].numeric = false;
+
+		} else if (!quote && !in_ident && sql_stmt_is_number(sctx.values[idx])) {
+			stmt->params[stmt->num_params].numeric = true;
+
+		} else {
+			TALLOC_FREE(prepared);
+			continue;
+		}
+
+		stmt->params[stmt->num_params].value = talloc_steal(stmt->params, sctx.values[idx]);
+		stmt->params[stmt->num_params].length = strlen(sctx.values[idx]);
+		stmt->num_params++;
+
+		if (inst->driver->flags & RLM_SQL_PARAM_FLAGS_NUMBERED) {
+			MEM(prepared = talloc_asprintf_append_buffer(prepared, "$%i", stmt->num_params));
+		} else {
+			MEM(prepared = talloc_strdup_append_buffer(prepared, "?"));
+		}
+	}
+
+	talloc_free(raw);
+	talloc_free(sctx.values);
+
+	stmt->query = query;
+	stmt->prepared = prepared;
+	*out = stmt;
+
+	return 0;
+}
+
+/** Execute a statement using the driver's sql_query or sql_query_prepared method
+ *
+ */
+static sql_rcode_t sql_stmt_exec(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle,
+				 sql_stmt_t const *stmt)
+{
+	ROPTIONAL(RDEBUG2, DEBUG2, "Executing query: %s", stmt->query);
+
+	if (stmt->prepared) {
+		ROPTIONAL(RDEBUG3, DEBUG3, "Using prepared statement: %s", stmt->prepared);
+		return (inst->driver->sql_query_prepared)(handle, inst->config, stmt->prepared,
+							  stmt->params, stmt->num_params);
+	}
+
+	return (inst->driver->sql_query)(handle, inst->config, stmt->query);
+}
+
 /** Call the driver's sql_query method, reconnecting if necessary.
  *
  * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
@@ -325,32 +927,56 @@ void rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle
  *	- #RLM_SQL_ALT_QUERY on constraints violation.
  */
 sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query)
+{
+	sql_stmt_t stmt = { .query = query };
+
+	return rlm_sql_query_stmt(inst, request, handle, &stmt);
+}
+
+/** Call the driver's sql_query or sql_query_prepared method, reconnecting if necessary.
+ *
+ * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ * 	previous reconnection attempt has failed.
+ * @param request Current request.
+ * @param inst #rlm_sql_t instance data.
+ * @param stmt to execute, as created by #sql_stmt_aeval.
+ * @return
+ *	- #RLM_SQL_OK on success.
+ *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ *	- #RLM_SQL_ALT_QUERY on constraints violation.
+ */
+sql_rcode_t rlm_sql_query_stmt(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+			       sql_stmt_t const *stmt)
 {
 	int ret = RLM_SQL_ERROR;
 	int i, count;
+	fr_pool_t *pool;
 
 	/* Caller should check they have a valid handle */
 	rad_assert(*handle);
 
 	/* There's no query to run, return an error */
-	if (query[0] == '\0') {
+	if (stmt->query[0] == '\0') {
 		if (request) REDEBUG("Zero length query");
 		return RLM_SQL_QUERY_INVALID;
 	}
 
 	/*
-	 *  inst->pool may be NULL is this function is called by mod_conn_create.
+	 *  The pool may be NULL is this function is called by mod_conn_create.
 	 */
-	count = inst->pool ? fr_pool_state(inst->pool)->num : 0;
+	pool = sql_handle_pool(inst, *handle);
+	count = pool ? fr_pool_state(pool)->num : 0;
 
 	/*
 	 *  Here we try with each of the existing connections, then try to create
 	 *  a new connection, then give up.
 	 */
 	for (i = 0; i < (count + 1); i++) {
-		ROPTIONAL(RDEBUG2, DEBUG2, "Executing query: %s", query);
-
-		ret = (inst->driver->sql_query)(*handle, inst->config, query);
+		ret = sql_stmt_exec(inst, request, *handle, stmt);
 		switch (ret) {
 		case RLM_SQL_OK:
 			break;
@@ -360,56 +986,155 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 		 *	sockets in the pool and fail to establish a *new* connection.
 		 */
 		case RLM_SQL_RECONNECT:
-			*handle = fr_pool_connection_reconnect(inst->pool, request, *handle);
+			*handle = fr_pool_connection_reconnect(pool, request, *handle);
 			/* Reconnection failed */
 			if (!*handle) return RLM_SQL_RECONNECT;
 			/* Reconnection succeeded, try again with the new handle */
 			continue;
 
-		/*
-		 *	These are bad and should make rlm_sql return invalid
-		 */
-		case RLM_SQL_QUERY_INVALID:
-			rlm_sql_print_error(inst, request, *handle, false);
-			(inst->driver->sql_finish_query)(*handle, inst->config);
+		default:
+			ret = sql_query_rcode(inst, request, *handle, ret);
 			break;
+		}
 
-		/*
-		 *	Server or client errors.
-		 *
-		 *	If the driver claims to be able to distinguish between
-		 *	duplicate row errors and other errors, and we hit a
-		 *	general error treat it as a failure.
-		 *
-		 *	Otherwise rewrite it to RLM_SQL_ALT_QUERY.
-		 */
-		case RLM_SQL_ERROR:
-			if (inst->driver->flags & RLM_SQL_RCODE_FLAGS_ALT_QUERY) {
-				rlm_sql_print_error(inst, request, *handle, false);
-				(inst->driver->sql_finish_query)(*handle, inst->config);
-				break;
-			}
-			ret = RLM_SQL_ALT_QUERY;
-			/* FALL-THROUGH */
+		return ret;
+	}
 
-		/*
-		 *	Driver suggested using an alternative query
-		 */
-		case RLM_SQL_ALT_QUERY:
-			rlm_sql_print_error(inst, request, *handle, true);
-			(inst->driver->sql_finish_query)(*handle, inst->config);
+	ROPTIONAL(RERROR, ERROR, "Hit reconnection limit");
+
+	return RLM_SQL_ERROR;
+}
+
+/** Call the driver's sql_query method once, without reconnecting
+ *
+ * Used when the query must be executed on a specific connection,
+ * e.g. because it's part of a transaction.
+ *
+ * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with.
+ * @param query to execute.
+ * @return
+ *	- #RLM_SQL_OK on success.
+ *	- #RLM_SQL_RECONNECT if the connection failed.
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ *	- #RLM_SQL_ALT_QUERY on constraints violation.
+ */
+sql_rcode_t rlm_sql_query_once(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, char const *query)
+{
+	sql_stmt_t stmt = { .query = query };
+
+	return rlm_sql_query_stmt_once(inst, request, handle, &stmt);
+}
+
+/** Call the driver's sql_query or sql_query_prepared method once, without reconnecting
+ *
+ * @see rlm_sql_query_once
+ */
+sql_rcode_t rlm_sql_query_stmt_once(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle,
+				    sql_stmt_t const *stmt)
+{
+	sql_rcode_t ret;
+
+	ret = sql_stmt_exec(inst, request, handle, stmt);
+	if (ret == RLM_SQL_RECONNECT) return ret;
+
+	return sql_query_rcode(inst, request, handle, ret);
+}
+
+/** Call the driver's sql_query_async method, reconnecting if necessary.
+ *
+ * The driver must provide the asynchronous interface.  Once the query
+ * has been sent, rlm_sql_query_async_result should be called each time
+ * the handle's file descriptor becomes readable.
+ *
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ * 	previous reconnection attempt has failed.
+ * @param request Current request.
+ * @param inst #rlm_sql_t instance data.
+ * @param query to execute. Should not be zero length.
+ * @return
+ *	- #RLM_SQL_OK if the query was sent.
+ *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ *	- #RLM_SQL_ALT_QUERY on constraints violation.
+ */
+sql_rcode_t rlm_sql_query_async(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query)
+{
+	int ret = RLM_SQL_ERROR;
+	int i, count;
+
+	rad_assert(*handle);
+	rad_assert(inst->driver->sql_query_async);
+
+	if (query[0] == '\0') {
+		REDEBUG("Zero length query");
+		return RLM_SQL_QUERY_INVALID;
+	}
+
+	count = fr_pool_state(inst->pool)->num;
+
+	for (i = 0; i < (count + 1); i++) {
+		RDEBUG2("Executing query: %s", query);
+
+		ret = (inst->driver->sql_query_async)(*handle, inst->config, query);
+		switch (ret) {
+		case RLM_SQL_OK:
 			break;
 
+		case RLM_SQL_RECONNECT:
+			*handle = fr_pool_connection_reconnect(inst->pool, request, *handle);
+			if (!*handle) return RLM_SQL_RECONNECT;
+			continue;
+
+		default:
+			ret = sql_query_rcode(inst, request, *handle, ret);
+			break;
 		}
 
 		return ret;
 	}
 
-	ROPTIONAL(RERROR, ERROR, "Hit reconnection limit");
+	RERROR("Hit reconnection limit");
 
 	return RLM_SQL_ERROR;
 }
 
+/** Call the driver's sql_query_async_result method
+ *
+ * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle the query was sent with.
+ * @return
+ *	- #RLM_SQL_OK on success.
+ *	- #RLM_SQL_YIELD if the result isn't available yet.
+ *	- #RLM_SQL_RECONNECT if the connection failed, and the query should be sent again
+ *	  with a new handle.
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ *	- #RLM_SQL_ALT_QUERY on constraints violation.
+ */
+sql_rcode_t rlm_sql_query_async_result(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle)
+{
+	sql_rcode_t ret;
+
+	ret = (inst->driver->sql_query_async_result)(handle, inst->config);
+	switch (ret) {
+	case RLM_SQL_OK:
+	case RLM_SQL_YIELD:
+	case RLM_SQL_RECONNECT:
+		return ret;
+
+	default:
+		return sql_query_rcode(inst, request, handle, ret);
+	}
+}
+
 /** Call the driver's sql_select_query method, reconnecting if necessary.
  *
  * @note Caller must call ``(inst->driver->sql_finish_select_query)(handle, inst->config);``
@@ -429,6 +1154,7 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 {
 	int ret = RLM_SQL_ERROR;
 	int i, count;
+	fr_pool_t *pool;
 
 	/* Caller should check they have a valid handle */
 	rad_assert(*handle);
@@ -441,9 +1167,10 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 	}
 
 	/*
-	 *  inst->pool may be NULL is this function is called by mod_conn_create.
+	 *  The pool may be NULL is this function is called by mod_conn_create.
 	 */
-	count = inst->pool ? fr_pool_state(inst->pool)->num : 0;
+	pool = sql_handle_pool(inst, *handle);
+	count = pool ? fr_pool_state(pool)->num : 0;
 
 	/*
 	 *  For sanity, for when no connections are viable, and we can't make a new one
@@ -461,7 +1188,7 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 		 *	sockets in the pool and fail to establish a *new* connection.
 		 */
 		case RLM_SQL_RECONNECT:
-			*handle = fr_pool_connection_reconnect(inst->pool, request, *handle);
+			*handle = fr_pool_connection_reconnect(pool, request, *handle);
 			/* Reconnection failed */
 			if (!*handle) return RLM_SQL_RECONNECT;
 			/* Reconnection succeeded, try again with the new handle */
@@ -494,17 +1221,17 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
 		  VALUE_PAIR **pair, char const *query)
 {
-	rlm_sql_row_t	row;
-	int		rows = 0;
-	sql_rcode_t	rcode;
+	fr_value_box_t const	*row;
+	int			rows = 0;
+	sql_rcode_t		rcode;
 
 	rad_assert(request);
 
 	rcode = rlm_sql_select_query(inst, request, handle, query);
 	if (rcode != RLM_SQL_OK) return -1; /* error handled by rlm_sql_select_query */
 
-	while (rlm_sql_fetch_row(&row, inst, request, handle) == RLM_SQL_OK) {
-		if (sql_fr_pair_list_afrom_str(ctx, request, pair, row) != 0) {
+	while (rlm_sql_fetch_row_boxed(&row, inst, request, handle) == RLM_SQL_OK) {
+		if (sql_fr_pair_list_afrom_boxes(ctx, request, pair, row, talloc_array_length(row)) != 0) {
 			REDEBUG("Error parsing user data from database result");
 
 			(inst->driver->sql_finish_select_query)(*handle, inst->config);
@@ -69,10 +69,37 @@ typedef struct rlm_sqlcounter_t {
 	char const	*query;		//!< SQL query to retrieve current session time.
 	char const	*reset;  	//!< Daily, weekly, monthly, never or user defined.
 
+	uint32_t	cache_lifetime;	//!< How long a counter read from SQL is used for.
+	uint32_t	cache_max_entries;	//!< Maximum number of counters to cache.
+	vp_tmpl_t	*acct_attr;	//!< Acct-Session-Time.
+	vp_tmpl_t	*session_attr;	//!< Acct-Unique-Session-Id.
+
+	rbtree_t	*cache;		//!< Cached counters, by key.
+	pthread_mutex_t	cache_mutex;	//!< Protects the cache.
+
 	time_t		reset_time;
 	time_t		last_reset;
 } rlm_sqlcounter_t;
 
+/** A counter read from SQL, and updated by accounting packets since
+ *
+ */
+typedef struct {
+	char const	*key;		//!< Printed value of the key attribute.
+	time_t		period;		//!< last_reset when the counter was read.
+	time_t		expires;	//!< When the counter must be read from SQL again.
+	uint64_t	counter;	//!< Current value.
+	rbtree_t	*sessions;	//!< Sessions seen, to turn their totals into increments.
+} sqlcounter_entry_t;
+
+/** The last total seen for a session
+ *
+ */
+typedef struct {
+	char const	*id;		//!< Printed value of the session attribute.
+	uint64_t	value;		//!< Last value of the accounting attribute.
+} sqlcounter_session_t;
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("sql_module_instance", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_sqlcounter_t, sqlmod_inst) },
 
@@ -88,6 +115,11 @@ static const CONF_PARSER module_config[] = {
 
 	/* Attribute to write remaining session to */
 	{ FR_CONF_OFFSET("reply_name", FR_TYPE_TMPL | FR_TYPE_ATTRIBUTE, rlm_sqlcounter_t, reply_attr) },
+
+	{ FR_CONF_OFFSET("cache_lifetime", FR_TYPE_UINT32, rlm_sqlcounter_t, cache_lifetime), .dflt = "0" },
+	{ FR_CONF_OFFSET("cache_max_entries", FR_TYPE_UINT32, rlm_sqlcounter_t, cache_max_entries), .dflt = "16384" },
+	{ FR_CONF_OFFSET("accounting_name", FR_TYPE_TMPL | FR_TYPE_ATTRIBUTE, rlm_sqlcounter_t, acct_attr), .dflt = "&request:Acct-Session-Time", .quote = T_BARE_WORD },
+	{ FR_CONF_OFFSET("session_name", FR_TYPE_TMPL | FR_TYPE_ATTRIBUTE, rlm_sqlcounter_t, session_attr), .dflt = "&request:Acct-Unique-Session-Id", .quote = T_BARE_WORD },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -329,15 +361,46 @@ static size_t sqlcounter_expand(char *out, int outlen, rlm_sqlcounter_t const *i
 }
 
 
-/*
- *	See if the counter matches.
+static int sqlcounter_entry_cmp(void const *one, void const *two)
+{
+	sqlcounter_entry_t const *a = one, *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+static int sqlcounter_session_cmp(void const *one, void const *two)
+{
+	sqlcounter_session_t const *a = one, *b = two;
+
+	return strcmp(a->id, b->id);
+}
+
+/** Find the key attribute
+ *
+ * User-Name is special.  It means the REAL username, after stripping.
  */
-static int counter_cmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req , VALUE_PAIR *check,
-		       UNUSED VALUE_PAIR *check_pairs, UNUSED VALUE_PAIR **reply_pairs)
+static VALUE_PAIR *sqlcounter_key(rlm_sqlcounter_t const *inst, REQUEST *request)
 {
-	rlm_sqlcounter_t const *inst = instance;
-	uint64_t counter;
+	VALUE_PAIR *key_vp;
+
+	if ((inst->key_attr->tmpl_list == PAIR_LIST_REQUEST) &&
+	    (inst->key_attr->tmpl_da->vendor == 0) && (inst->key_attr->tmpl_da->attr == FR_USER_NAME)) {
+		return request->username;
+	}
+
+	if (tmpl_find_vp(&key_vp, request, inst->key_attr) < 0) return NULL;
+
+	return key_vp;
+}
 
+/** Run the SQL query to get the current value of the counter
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int sqlcounter_query(uint64_t *out, rlm_sqlcounter_t const *inst, REQUEST *request)
+{
 	char query[MAX_QUERY_LEN], subst[MAX_QUERY_LEN];
 	char *expanded = NULL;
 	size_t len;
@@ -346,27 +409,115 @@ static int counter_cmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 	if (sqlcounter_expand(subst, sizeof(subst), inst, request, inst->query) <= 0) {
 		REDEBUG("Insufficient query buffer space");
 
-		return RLM_MODULE_FAIL;
+		return -1;
 	}
 
 	/* Then combine that with the name of the module were using to do the query */
 	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, subst);
-	if (len >= sizeof(query) - 1) {
+	if (len >= (sizeof(query) - 1)) {
 		REDEBUG("Insufficient query buffer space");
 
-		return RLM_MODULE_FAIL;
+		return -1;
 	}
 
 	/* Finally, xlat resulting SQL query */
-	if (xlat_aeval(request, &expanded, request, query, NULL, NULL) < 0) {
-		return RLM_MODULE_FAIL;
-	}
+	if (xlat_aeval(request, &expanded, request, query, NULL, NULL) < 0) return -1;
 
-	if (sscanf(expanded, "%" PRIu64, &counter) != 1) {
-		RDEBUG2("No integer found in string \"%s\"", expanded);
+	if (sscanf(expanded, "%" PRIu64, out) != 1) {
+		RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
+			expanded);
+		*out = 0;
 	}
 	talloc_free(expanded);
 
+	return 0;
+}
+
+/** Get the current value of the counter for a key
+ *
+ * If counters are cached, and the key's counter was read from SQL less
+ * than cache_lifetime seconds ago, the cached value (including any
+ * accounting updates since) is used.  Otherwise the SQL query is run,
+ * and its result cached.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int sqlcounter_get(uint64_t *out, rlm_sqlcounter_t *inst, REQUEST *request, VALUE_PAIR *key_vp)
+{
+	sqlcounter_entry_t	find, *entry;
+	char			*key;
+	time_t			now;
+
+	if (!inst->cache_lifetime || !key_vp) return sqlcounter_query(out, inst, request);
+
+	now = time(NULL);
+	MEM(key = fr_pair_value_asprint(request, key_vp, '\0'));
+	find.key = key;
+
+	pthread_mutex_lock(&inst->cache_mutex);
+	entry = rbtree_finddata(inst->cache, &find);
+	if (entry && (entry->period == inst->last_reset) && (entry->expires > now)) {
+		*out = entry->counter;
+		pthread_mutex_unlock(&inst->cache_mutex);
+
+		RDEBUG2("Using cached counter value (%" PRIu64 ")", *out);
+		talloc_free(key);
+		return 0;
+	}
+	pthread_mutex_unlock(&inst->cache_mutex);
+
+	if (sqlcounter_query(out, inst, request) < 0) {
+		talloc_free(key);
+		return -1;
+	}
+
+	pthread_mutex_lock(&inst->cache_mutex);
+	entry = rbtree_finddata(inst->cache, &find);
+	if (!entry) {
+		if (inst->cache_max_entries && (rbtree_num_elements(inst->cache) >= inst->cache_max_entries)) {
+			pthread_mutex_unlock(&inst->cache_mutex);
+			RDEBUG2("Counter cache is full, not caching counter");
+			talloc_free(key);
+			return 0;
+		}
+
+		MEM(entry = talloc_zero(inst->cache, sqlcounter_entry_t));
+		entry->key = talloc_steal(entry, key);
+		key = NULL;
+		MEM(entry->sessions = rbtree_create(entry, sqlcounter_session_cmp, NULL, RBTREE_FLAG_NONE));
+		rbtree_insert(inst->cache, entry);
+
+	/*
+	 *	The sessions we've seen are only valid
+	 *	for the period they were seen in.
+	 */
+	} else if (entry->period != inst->last_reset) {
+		talloc_free(entry->sessions);
+		MEM(entry->sessions = rbtree_create(entry, sqlcounter_session_cmp, NULL, RBTREE_FLAG_NONE));
+	}
+	entry->period = inst->last_reset;
+	entry->expires = now + inst->cache_lifetime;
+	entry->counter = *out;
+	pthread_mutex_unlock(&inst->cache_mutex);
+
+	talloc_free(key);
+
+	return 0;
+}
+
+/*
+ *	See if the counter matches.
+ */
+static int counter_cmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req , VALUE_PAIR *check,
+		       UNUSED VALUE_PAIR *check_pairs, UNUSED VALUE_PAIR **reply_pairs)
+{
+	rlm_sqlcounter_t *inst = instance;
+	uint64_t counter;
+
+	if (sqlcounter_get(&counter, inst, request, sqlcounter_key(inst, request)) < 0) return RLM_MODULE_FAIL;
+
 	if (counter < check->vp_uint64) return -1;
 	if (counter > check->vp_uint64) return 1;
 	return 0;
@@ -387,11 +538,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
 	char			msg[128];
 	int			ret;
 
-	char query[MAX_QUERY_LEN], subst[MAX_QUERY_LEN];
-	char *expanded = NULL;
-
-	size_t len;
-
 	/*
 	 *	Before doing anything else, see if we have to reset
 	 *	the counters.
@@ -402,18 +548,20 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
 		 */
 		inst->last_reset = inst->reset_time;
 		find_next_reset(inst,request->packet->timestamp.tv_sec);
-	}
 
-	/*
-	 *      Look for the key.  User-Name is special.  It means
-	 *      The REAL username, after stripping.
-	 */
-	if ((inst->key_attr->tmpl_list == PAIR_LIST_REQUEST) &&
-	    (inst->key_attr->tmpl_da->vendor == 0) && (inst->key_attr->tmpl_da->attr == FR_USER_NAME)) {
-		key_vp = request->username;
-	} else {
-		tmpl_find_vp(&key_vp, request, inst->key_attr);
+		/*
+		 *	Cached counters are all for the previous
+		 *	period now.
+		 */
+		if (inst->cache) {
+			pthread_mutex_lock(&inst->cache_mutex);
+			talloc_free(inst->cache);
+			MEM(inst->cache = rbtree_create(inst, sqlcounter_entry_cmp, NULL, RBTREE_FLAG_NONE));
+			pthread_mutex_unlock(&inst->cache_mutex);
+		}
 	}
+
+	key_vp = sqlcounter_key(inst, request);
 	if (!key_vp) {
 		RWDEBUG2("Couldn't find key attribute, %s, doing nothing...", inst->key_attr->tmpl_da->name);
 		return RLM_MODULE_NOOP;
@@ -424,32 +572,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
 		return RLM_MODULE_NOOP;
 	}
 
-	/* First, expand %k, %b and %e in query */
-	if (sqlcounter_expand(subst, sizeof(subst), inst, request, inst->query) <= 0) {
-		REDEBUG("Insufficient query buffer space");
-
-		return RLM_MODULE_FAIL;
-	}
-
-	/* Then combine that with the name of the module were using to do the query */
-	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, subst);
-	if (len >= (sizeof(query) - 1)) {
-		REDEBUG("Insufficient query buffer space");
-
-		return RLM_MODULE_FAIL;
-	}
-
-	/* Finally, xlat resulting SQL query */
-	if (xlat_aeval(request, &expanded, request, query, NULL, NULL) < 0) {
-		return RLM_MODULE_FAIL;
-	}
-	talloc_free(expanded);
-
-	if (sscanf(expanded, "%" PRIu64, &counter) != 1) {
-		RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
-			expanded);
-		counter = 0;
-	}
+	if (sqlcounter_get(&counter, inst, request, key_vp) < 0) return RLM_MODULE_FAIL;
 
 	/*
 	 *	Check if check item > counter
@@ -525,6 +648,111 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
 	return RLM_MODULE_OK;
 }
 
+/** Update cached counters from accounting packets
+ *
+ * Accounting packets carry the running total for the session, so the
+ * increment is the difference from the last total seen for the session.
+ * If a session hasn't been seen before, and it isn't starting, the
+ * counter can't be updated, and is read from SQL again when it's next
+ * used.
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+{
+	rlm_sqlcounter_t	*inst = instance;
+	VALUE_PAIR		*vp, *key_vp, *acct_vp, *session_vp;
+	sqlcounter_entry_t	find_entry, *entry;
+	sqlcounter_session_t	find_session, *session;
+	uint64_t		value;
+	uint32_t		status;
+	char			*key, *id;
+	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
+
+	if (!inst->cache) return RLM_MODULE_NOOP;
+
+	vp = fr_pair_find_by_num(request->packet->vps, 0, FR_ACCT_STATUS_TYPE, TAG_ANY);
+	if (!vp) return RLM_MODULE_NOOP;
+	status = vp->vp_uint32;
+
+	switch (status) {
+	case FR_STATUS_START:
+	case FR_STATUS_ALIVE:
+	case FR_STATUS_STOP:
+		break;
+
+	default:
+		return RLM_MODULE_NOOP;
+	}
+
+	key_vp = sqlcounter_key(inst, request);
+	if (!key_vp) return RLM_MODULE_NOOP;
+
+	if (tmpl_find_vp(&session_vp, request, inst->session_attr) < 0) session_vp = NULL;
+
+	value = 0;
+	if (tmpl_find_vp(&acct_vp, request, inst->acct_attr) == 0) {
+		switch (acct_vp->vp_type) {
+		case FR_TYPE_UINT32:
+			value = acct_vp->vp_uint32;
+			break;
+
+		case FR_TYPE_UINT64:
+			value = acct_vp->vp_uint64;
+			break;
+
+		default:
+			RWDEBUG("%s is not an integer, can't update counter", inst->acct_attr->name);
+			session_vp = NULL;
+			break;
+		}
+	}
+
+	MEM(key = fr_pair_value_asprint(request, key_vp, '\0'));
+	id = session_vp ? fr_pair_value_asprint(request, session_vp, '\0') : NULL;
+
+	find_entry.key = key;
+	find_session.id = id;
+
+	pthread_mutex_lock(&inst->cache_mutex);
+	entry = rbtree_finddata(inst->cache, &find_entry);
+	if (!entry || (entry->period != inst->last_reset)) goto done;
+
+	if (!id) {
+		RDEBUG2("Can't identify the session, cached counter will be read from SQL");
+		entry->expires = 0;
+		goto done;
+	}
+
+	session = rbtree_finddata(entry->sessions, &find_session);
+	if (!session) {
+		if (status != FR_STATUS_START) {
+			RDEBUG2("Session started before the counter was read, cached counter will be read from SQL");
+			entry->expires = 0;
+			goto done;
+		}
+
+		MEM(session = talloc_zero(entry->sessions, sqlcounter_session_t));
+		session->id = talloc_steal(session, id);
+		id = NULL;
+		rbtree_insert(entry->sessions, session);
+	}
+
+	if (value > session->value) {
+		entry->counter += value - session->value;
+		session->value = value;
+	}
+	RDEBUG2("Cached counter is now %" PRIu64, entry->counter);
+
+	if (status == FR_STATUS_STOP) rbtree_deletebydata(entry->sessions, session);
+	rcode = RLM_MODULE_UPDATED;
+
+done:
+	pthread_mutex_unlock(&inst->cache_mutex);
+	talloc_free(key);
+	talloc_free(id);
+
+	return rcode;
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -560,6 +788,24 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->cache_lifetime) {
+		inst->cache = rbtree_create(inst, sqlcounter_entry_cmp, NULL, RBTREE_FLAG_NONE);
+		if (!inst->cache) {
+			cf_log_err(conf, "Failed creating counter cache");
+			return -1;
+		}
+		pthread_mutex_init(&inst->cache_mutex, NULL);
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_sqlcounter_t *inst = instance;
+
+	if (inst->cache) pthread_mutex_destroy(&inst->cache_mutex);
+
 	return 0;
 }
 
@@ -626,8 +872,10 @@ rad_module_t rlm_sqlcounter = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 	.methods = {
-		[MOD_AUTHORIZE]		= mod_authorize
+		[MOD_AUTHORIZE]		= mod_authorize,
+		[MOD_ACCOUNTING]	= mod_accounting
 	},
 };
 
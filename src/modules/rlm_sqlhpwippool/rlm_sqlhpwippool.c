@@ -26,7 +26,6 @@
  * - of course uses dirty hacks to get access to the database
  * - queries and table names are not configurable
  * - IPv4 only (I don't even care about IPv6 by now)
- * - pool names (fetched from database) are not "escaped"
  * - you have to set encoding of radius.acctuniqueid to same as
  *   netvim.ips.rsv_by
  *
@@ -55,9 +54,6 @@ typedef struct rlm_sqlhpwippool_t {
 	char const		*myname;	 		//!< Name of this instance
 	rlm_sql_t		*sql_inst;
 	rlm_sql_driver_t const	*db;
-#ifdef HAVE_PTHREAD_D
-	pthread_mutex_t		mutex;			//!< Used "with" sync_after
-#endif
 	uint32_t		sincesync;		//!< req. done so far since last free IP sync.
 
 	/* from config */
@@ -117,86 +113,44 @@ static int nvp_finish(rlm_sqlhpwippool_t *data, rlm_sql_handle_t *sqlsock)
 	return (data->db->sql_finish_query)(sqlsock, data->sql_inst->config);
 }
 
-/* executes query and fetches first row
- * -1 on no results
- *  0 on db error
- *  1 on success */
-static int nvp_select(rlm_sql_row_t *row, rlm_sqlhpwippool_t *data,
-		      rlm_sql_handle_t *sqlsock, char const *fmt, ...)
-{
-	va_list ap;
-
-	va_start(ap, fmt);
-	if (!nvp_vquery(data, sqlsock, fmt, ap)) {
-		va_end(ap);
-		return 0;
-	}
-	va_end(ap);
-
-	if (data->db->sql_store_result && (data->db->sql_store_result)(sqlsock, data->sql_inst->config)) {
-		ERROR("nvp_select(): error while saving results of query");
-		return 0;
-	}
-
-	if (data->db->sql_num_rows && ((data->db->sql_num_rows)(sqlsock, data->sql_inst->config) < 1)) {
-		DEBUG("nvp_select(): no results in query");
-		return -1;
-	}
-
-	if ((data->db->sql_fetch_row)(row, sqlsock, data->sql_inst->config)) {
-		ERROR("nvp_select(): couldn't fetch row from results of query");
-		return 0;
-	}
-
-	return 1;
-}
+/* frees IPs of closed sessions (eg. by external modifications to db) */
+#define NVP_FREECLOSED_QUERY \
+	"UPDATE `%1$s`.`ips`, `radacct` " \
+		"SET " \
+			"`ips`.`rsv_until` = `radacct`.`acctstoptime` + INTERVAL %2$u SECOND " \
+		"WHERE " \
+			"`radacct`.`acctstoptime` IS NOT NULL AND "   /* session is closed */ \
+			"("				    /* address is being used */ \
+				"`ips`.`pid` IS NOT NULL AND " \
+				"(`rsv_until` = 0 OR `rsv_until` > NOW())" \
+			") AND " \
+			"`radacct`.`acctuniqueid` = `ips`.`rsv_by`"
 
-static int nvp_select_finish(rlm_sqlhpwippool_t *data, rlm_sql_handle_t *sqlsock)
-{
-	return ((data->db->sql_free_result)(sqlsock, data->sql_inst->config) ||
-		nvp_finish(data, sqlsock));
-}
+/* updates number of free IP addresses in pools */
+#define NVP_SYNCFREE_QUERY \
+	"UPDATE `%1$s`.`ip_pools` " \
+		"SET `ip_pools`.`free` = " \
+			"(SELECT COUNT(*) " \
+				"FROM `%1$s`.`ips` " \
+				"WHERE " \
+					"`ips`.`ip` BETWEEN " \
+						"`ip_pools`.`ip_start` AND `ip_pools`.`ip_stop` AND " \
+					"(" \
+						"`ips`.`pid` IS NULL OR " \
+						"(`ips`.`rsv_until` > 0 AND `ips`.`rsv_until` < NOW())" \
+					"))"
 
-/* frees IPs of closed sessions (eg. by external modifications to db) */
 static int nvp_freeclosed(rlm_sqlhpwippool_t *data, rlm_sql_handle_t *sqlsock)
 {
-	if (!nvp_query(data, sqlsock,
-	    "UPDATE `%s`.`ips`, `radacct` "
-		"SET "
-			"`ips`.`rsv_until` = `radacct`.`acctstoptime` + INTERVAL %u SECOND "
-		"WHERE "
-			"`radacct`.`acctstoptime` IS NOT NULL AND "   /* session is closed */
-			"("				    /* address is being used */
-				"`ips`.`pid` IS NOT NULL AND "
-				"(`rsv_until` = 0 OR `rsv_until` > NOW())"
-			") AND "
-			"`radacct`.`acctuniqueid` = `ips`.`rsv_by`",
-	    data->db_name, data->free_after)) {
-		return 0;
-	}
+	if (!nvp_query(data, sqlsock, NVP_FREECLOSED_QUERY, data->db_name, data->free_after)) return 0;
 
 	nvp_finish(data, sqlsock);
 	return 1;
 }
 
-/* updates number of free IP addresses in pools */
 static int nvp_syncfree(rlm_sqlhpwippool_t *data, rlm_sql_handle_t *sqlsock)
 {
-	if (!nvp_query(data, sqlsock,
-	    "UPDATE `%s`.`ip_pools` "
-		"SET `ip_pools`.`free` = "
-			"(SELECT COUNT(*) "
-				"FROM `%1$s`.`ips` "
-				"WHERE "
-					"`ips`.`ip` BETWEEN "
-						"`ip_pools`.`ip_start` AND `ip_pools`.`ip_stop` AND "
-					"("
-						"`ips`.`pid` IS NULL OR "
-						"(`ips`.`rsv_until` > 0 AND `ips`.`rsv_until` < NOW())"
-					"))",
-	    data->db_name)) {
-		return 0;
-	}
+	if (!nvp_query(data, sqlsock, NVP_SYNCFREE_QUERY, data->db_name)) return 0;
 
 	nvp_finish(data, sqlsock);
 	return 1;
@@ -289,22 +243,454 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return ((nvp_cleanup(inst)) ? 0 : -1);
 }
 
-/* assign new IP address, if required */
+/* finds a free IP address, with the attempt's offset into the candidate pools
+ *
+ * The candidates are the enabled pools with the requested name, and free
+ * addresses, in the host groups the NAS belongs to.  They're ordered by
+ * how specific the group is, then by the pool's prio, then by how far
+ * its usage is below its share of the prio's weight.
+ *
+ * A single attempt reserves an address from the candidate at "offset",
+ * and updates the pool's free count, in one transaction.  The batch ends
+ * with the reserved address (NULL if the pool had none free after all)
+ * and the candidate's pid (NULL if there are no more candidates).
+ */
+#define NVP_ALLOC_QUERY \
+	"SET @nvp_ip = NULL, @nvp_pid = NULL, @nvp_start = NULL, @nvp_stop = NULL; " \
+	"START TRANSACTION; " \
+	"SELECT `c`.`pid`, `c`.`ip_start`, `c`.`ip_stop` " \
+		"INTO @nvp_pid, @nvp_start, @nvp_stop " \
+		"FROM (" \
+			"SELECT " \
+				"`ip_pools`.`pid`, " \
+				"`ip_pools`.`ip_start`, " \
+				"`ip_pools`.`ip_stop` " \
+			"FROM " \
+				"`%1$s`.`ip_pools`, " \
+				"`%1$s`.`ids`, " \
+				"`%1$s`.`pool_names`, " \
+				"(SELECT " \
+					"`host_groups`.`gid`, " \
+					"MIN(`gid_ip`.`ip_stop` - `gid_ip`.`ip_start`) AS `width` " \
+					"FROM " \
+						"`%1$s`.`host_groups`, " \
+						"`%1$s`.`gid_ip`, " \
+						"`%1$s`.`ids` " \
+					"WHERE " \
+						"`host_groups`.`gid` = `ids`.`id` AND " \
+						"`ids`.`enabled` = 1 AND " \
+						"`host_groups`.`gid` = `gid_ip`.`gid` AND " \
+						"%3$lu BETWEEN `gid_ip`.`ip_start` AND `gid_ip`.`ip_stop` " \
+					"GROUP BY `host_groups`.`gid`" \
+				") AS `groups`, " \
+				"(SELECT " \
+					"`ip_pools`.`gid`, " \
+					"`ip_pools`.`prio`, " \
+					"SUM(`ip_pools`.`weight`) AS `weights_sum`, " \
+					"(SUM(`ip_pools`.`total`) - " \
+						"SUM(`ip_pools`.`free`)) AS `used_sum` " \
+					"FROM " \
+						"`%1$s`.`ip_pools`, " \
+						"`%1$s`.`ids`, " \
+						"`%1$s`.`pool_names` " \
+					"WHERE " \
+						"`ids`.`id` = `ip_pools`.`pid` AND " \
+						"`ids`.`enabled` = 1 AND " \
+						"`pool_names`.`pnid` = `ip_pools`.`pnid` AND " \
+						"`pool_names`.`name` = '%2$s' AND " \
+						"`ip_pools`.`free` > 0 " \
+					"GROUP BY `ip_pools`.`gid`, `ip_pools`.`prio`" \
+				") AS `prios` " \
+			"WHERE " \
+				"`ip_pools`.`gid` = `groups`.`gid` AND " \
+				"`ip_pools`.`gid` = `prios`.`gid` AND " \
+				"`ip_pools`.`prio` = `prios`.`prio` AND " \
+				"`ids`.`id` = `ip_pools`.`pid` AND " \
+				"`ids`.`enabled` = 1 AND " \
+				"`pool_names`.`pnid` = `ip_pools`.`pnid` AND " \
+				"`pool_names`.`name` = '%2$s' AND " \
+				"`ip_pools`.`free` > 0 " \
+			"ORDER BY " \
+				"`groups`.`width` ASC, " \
+				"`groups`.`gid` ASC, " \
+				"`ip_pools`.`prio` ASC, " \
+				"(`ip_pools`.`weight` / `prios`.`weights_sum` - " \
+					"(`ip_pools`.`total` - `ip_pools`.`free`) / `prios`.`used_sum`) DESC " \
+			"LIMIT %4$lu, 1" \
+		") AS `c`; " \
+	"UPDATE `%1$s`.`ips` " \
+		"SET " \
+			"`pid` = @nvp_pid, " \
+			"`rsv_since` = NOW(), " \
+			"`rsv_by` = CONCAT('" RLM_NETVIM_TMP_PREFIX "', CONNECTION_ID()), " \
+			"`rsv_until` = NOW() + INTERVAL %5$u SECOND, " \
+			"`ip` = (@nvp_ip := `ip`) " \
+		"WHERE " \
+			"`ip` BETWEEN @nvp_start AND @nvp_stop AND " \
+			"(" \
+				"`pid` IS NULL OR " \
+				"(`rsv_until` > 0 AND `rsv_until` < NOW())" \
+			") " \
+		"ORDER BY RAND() " \
+		"LIMIT 1; " \
+	"UPDATE `%1$s`.`ip_pools` " \
+		"SET " \
+			"`free` = `free` - 1 " \
+		"WHERE " \
+			"`pid` = @nvp_pid AND " \
+			"@nvp_ip IS NOT NULL " \
+		"LIMIT 1; " \
+	"COMMIT; " \
+	"SELECT @nvp_ip, @nvp_pid"
+
+typedef enum {
+	NVP_OP_ALLOC = 0,				//!< Allocating an address in post-auth.
+	NVP_OP_ACCT					//!< Updating an address with accounting data.
+} nvp_op_t;
+
+/** State for a query batch which is waiting on the database
+ *
+ */
+typedef struct {
+	rlm_sqlhpwippool_t	*inst;			//!< Module instance.
+	nvp_op_t		op;			//!< What the batch is for.
+	rlm_sql_handle_t	*handle;		//!< The batch was sent with.
+	bool			async;			//!< Whether the batch was sent with the driver's
+							///< asynchronous interface.
+	int			fd;			//!< We're waiting for a result on, or -1.
+	int			tries;			//!< Number of times the current batch was sent.
+	sql_rcode_t		sql_ret;		//!< What the driver returned.
+
+	char			*query;			//!< Accounting query.
+
+	char			*pname;			//!< Escaped name of the requested IP pool.
+	uint32_t		nasip;			//!< NAS IP in host byte order.
+	bool			sync;			//!< Sync with radacct before the next attempt.
+	unsigned long		offset;			//!< Of the candidate pool the next attempt uses.
+} nvp_async_t;
+
+static rlm_rcode_t nvp_send(REQUEST *request, nvp_async_t *state);
+
+/** Stop waiting for events on the handle's file descriptor
+ *
+ */
+static void nvp_fd_delete(REQUEST *request, nvp_async_t *state)
+{
+	if (state->fd < 0) return;
+
+	(void) unlang_event_fd_delete(request, state, state->fd);
+	state->fd = -1;
+}
+
+/** Release all resources used by the batch, and return its rcode
+ *
+ */
+static rlm_rcode_t nvp_done(REQUEST *request, nvp_async_t *state, rlm_rcode_t rcode)
+{
+	rlm_sqlhpwippool_t *inst = state->inst;
+
+	nvp_fd_delete(request, state);
+	if (state->handle) fr_pool_connection_release(inst->sql_inst->pool, request, state->handle);
+	talloc_free(state);
+
+	return rcode;
+}
+
+/** Give up on the batch, closing the connection
+ *
+ * An allocation may have left a transaction open, and a batch which is
+ * still in progress leaves the connection unusable, so the connection
+ * can't be returned to the pool.
+ */
+static rlm_rcode_t nvp_abort(REQUEST *request, nvp_async_t *state, rlm_rcode_t rcode)
+{
+	rlm_sqlhpwippool_t *inst = state->inst;
+
+	nvp_fd_delete(request, state);
+	if (state->handle) {
+		fr_pool_connection_close(inst->sql_inst->pool, request, state->handle);
+		state->handle = NULL;
+	}
+
+	return nvp_done(request, state, rcode);
+}
+
+/** Called when the handle's file descriptor is readable
+ *
+ */
+static void nvp_read(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx, UNUSED int fd)
+{
+	nvp_async_t	*state = talloc_get_type_abort(ctx, nvp_async_t);
+	sql_rcode_t	ret;
+
+	ret = rlm_sql_query_async_result(state->inst->sql_inst, request, state->handle);
+	if (ret == RLM_SQL_YIELD) return;
+
+	state->sql_ret = ret;
+	nvp_fd_delete(request, state);
+	unlang_resumable(request);
+}
+
+/** Called when there's an error on the handle's file descriptor
+ *
+ */
+static void nvp_error(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx, UNUSED int fd)
+{
+	nvp_async_t	*state = talloc_get_type_abort(ctx, nvp_async_t);
+
+	REDEBUG("Connection to the database failed whilst waiting for a result");
+
+	state->sql_ret = RLM_SQL_RECONNECT;
+	nvp_fd_delete(request, state);
+	unlang_resumable(request);
+}
+
+/** Nothing left to try, no free IP address found
+ *
+ */
+static rlm_rcode_t nvp_alloc_none(REQUEST *request, nvp_async_t *state)
+{
+	RINFO("No free IP address found!");
+
+	if (state->inst->no_free_fail) {
+		RDEBUG2("Rejecting user");
+		return nvp_done(request, state, RLM_MODULE_REJECT);
+	}
+
+	RDEBUG2("Exiting");
+	return nvp_done(request, state, RLM_MODULE_NOOP);
+}
+
+/** Process the result of an allocation attempt, and make the next one if required
+ *
+ */
+static rlm_rcode_t nvp_alloc_result(REQUEST *request, nvp_async_t *state)
+{
+	rlm_sqlhpwippool_t	*inst = state->inst;
+	rlm_sql_row_t		row = NULL;
+	struct in_addr		ip = {0};	/* reserved IP for client (net. byte order) */
+	unsigned long		pid = 0;
+	bool			candidate;
+	VALUE_PAIR		*vp;
+
+	/*
+	 *	rlm_sql_select_query stores the result itself,
+	 *	the asynchronous interface leaves it to us.
+	 */
+	if (state->async && inst->db->sql_store_result &&
+	    ((inst->db->sql_store_result)(state->handle, inst->sql_inst->config) != RLM_SQL_OK)) {
+		RERROR("Error while saving results of query");
+		return nvp_abort(request, state, RLM_MODULE_FAIL);
+	}
+
+	if (((inst->db->sql_fetch_row)(&row, state->handle, inst->sql_inst->config) != RLM_SQL_OK) || !row) {
+		RERROR("Couldn't fetch row from results of query");
+		return nvp_abort(request, state, RLM_MODULE_FAIL);
+	}
+
+	if (row[0]) ip.s_addr = htonl(strtoul(row[0], (char **) NULL, 10));
+	candidate = (row[1] != NULL);
+	if (candidate) pid = strtoul(row[1], (char **) NULL, 10);
+
+	(inst->db->sql_finish_query)(state->handle, inst->sql_inst->config);
+
+	if (!ip.s_addr) {
+		if (!candidate) {
+			RDEBUG2("Couldn't find any more matching pools");
+			return nvp_alloc_none(request, state);
+		}
+
+		RDEBUG2("Couldn't reserve an IP address from pool of pid = %lu", pid);
+		if (++state->offset >= RLM_NETVIM_MAX_ROWS) return nvp_alloc_none(request, state);
+
+		state->tries = 0;
+		return nvp_send(request, state);
+	}
+
+	nvp_done(request, state, RLM_MODULE_OK);
+
+	/* add IP address to reply packet */
+	vp = radius_pair_create(request->reply, &request->reply->vps, FR_FRAMED_IP_ADDRESS, 0);
+	vp->vp_ipv4addr = ip.s_addr;
+
+	RDEBUG2("Returning %s (pid = %lu)", inet_ntoa(ip), pid);
+	return RLM_MODULE_OK;
+}
+
+/** Process the result of a batch
+ *
+ */
+static rlm_rcode_t nvp_process(REQUEST *request, nvp_async_t *state)
+{
+	rlm_sqlhpwippool_t	*inst = state->inst;
+
+	switch (state->sql_ret) {
+	case RLM_SQL_OK:
+		if (state->op == NVP_OP_ALLOC) return nvp_alloc_result(request, state);
+
+		(inst->db->sql_finish_query)(state->handle, inst->sql_inst->config);
+		return nvp_done(request, state, RLM_MODULE_OK);
+
+	/*
+	 *	The connection failed after the batch was sent.
+	 *	Anything it did was rolled back when the connection
+	 *	went away, so send it again on a new connection.
+	 */
+	case RLM_SQL_RECONNECT:
+		if (!state->handle) return nvp_done(request, state, RLM_MODULE_FAIL);
+
+		if (!state->async || (state->tries > (int)fr_pool_state(inst->sql_inst->pool)->num)) {
+			RERROR("Hit reconnection limit");
+			return nvp_abort(request, state, RLM_MODULE_FAIL);
+		}
+
+		state->handle = fr_pool_connection_reconnect(inst->sql_inst->pool, request, state->handle);
+		if (!state->handle) return nvp_done(request, state, RLM_MODULE_FAIL);
+
+		return nvp_send(request, state);
+
+	default:
+		if (state->op == NVP_OP_ALLOC) {
+			RERROR("Failed reserving an IP address");
+			return nvp_abort(request, state, RLM_MODULE_FAIL);
+		}
+		return nvp_done(request, state, RLM_MODULE_FAIL);
+	}
+}
+
+static rlm_rcode_t nvp_resume(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx)
+{
+	return nvp_process(request, talloc_get_type_abort(ctx, nvp_async_t));
+}
+
+/** Cancel an outstanding batch if the request is stopped
+ *
+ */
+static void nvp_signal(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx,
+		       fr_state_action_t action)
+{
+	nvp_async_t	*state = talloc_get_type_abort(ctx, nvp_async_t);
+
+	if (action != FR_ACTION_DONE) return;
+
+	RDEBUG("Cancelling pending SQL query");
+
+	(void) nvp_abort(request, state, RLM_MODULE_FAIL);
+}
+
+/** Build and send the current batch, yielding until the result is available
+ *
+ * Drivers without an asynchronous interface, and requests without an
+ * event list, run the batch synchronously instead.
+ */
+static rlm_rcode_t nvp_send(REQUEST *request, nvp_async_t *state)
+{
+	rlm_sqlhpwippool_t	*inst = state->inst;
+	char			*query;
+
+	if (state->op == NVP_OP_ALLOC) {
+		query = talloc_strdup(state, "");
+
+		/* synchronize with radacct db, if needed */
+		if (state->sync) {
+			RDEBUG2("Syncing with radacct table");
+			query = talloc_asprintf_append_buffer(query, NVP_FREECLOSED_QUERY "; " NVP_SYNCFREE_QUERY "; ",
+							      inst->db_name, inst->free_after);
+			state->sync = false;
+		}
+
+		RDEBUG2("Selecting pool on position %lu", state->offset);
+		query = talloc_asprintf_append_buffer(query, NVP_ALLOC_QUERY,
+						      inst->db_name, state->pname, (unsigned long) state->nasip,
+						      state->offset, inst->free_after);
+		if (!query) return nvp_done(request, state, RLM_MODULE_FAIL);
+	} else {
+		query = state->query;
+	}
+
+	state->tries++;
+	state->async = (inst->db->sql_query_async && request->el);
+
+	if (!state->async) {
+		if (state->op == NVP_OP_ALLOC) {
+			state->sql_ret = rlm_sql_select_query(inst->sql_inst, request, &state->handle, query);
+		} else {
+			state->sql_ret = rlm_sql_query(inst->sql_inst, request, &state->handle, query);
+		}
+		if (query != state->query) talloc_free(query);
+
+		return nvp_process(request, state);
+	}
+
+	state->sql_ret = rlm_sql_query_async(inst->sql_inst, request, &state->handle, query);
+	if (query != state->query) talloc_free(query);
+	if (state->sql_ret != RLM_SQL_OK) return nvp_process(request, state);
+
+	/*
+	 *	The result may already be available, in which
+	 *	case the file descriptor won't become readable.
+	 */
+	state->sql_ret = rlm_sql_query_async_result(inst->sql_inst, request, state->handle);
+	if (state->sql_ret != RLM_SQL_YIELD) return nvp_process(request, state);
+
+	state->fd = (inst->db->sql_fd)(state->handle, inst->sql_inst->config);
+	if ((state->fd < 0) ||
+	    (unlang_event_fd_add(request, nvp_read, NULL, nvp_error, state, state->fd) < 0)) {
+		REDEBUG("Failed waiting for the result of the query");
+		state->fd = -1;
+		return nvp_abort(request, state, RLM_MODULE_FAIL);
+	}
+
+	return unlang_module_yield(request, nvp_resume, nvp_signal, state);
+}
+
+/** Allocate state for a batch, with a database connection
+ *
+ */
+static nvp_async_t *nvp_async_alloc(rlm_sqlhpwippool_t *inst, REQUEST *request, nvp_op_t op)
+{
+	nvp_async_t *state;
+
+	MEM(state = talloc_zero(request, nvp_async_t));
+	state->inst = inst;
+	state->op = op;
+	state->fd = -1;
+
+	state->handle = fr_pool_connection_get(inst->sql_inst->pool, request);
+	if (!state->handle) {
+		talloc_free(state);
+		return NULL;
+	}
+
+	return state;
+}
+
+/** Escape a value for use in a query, with the rlm_sql instance's escape function
+ *
+ */
+static char *nvp_escape(nvp_async_t *state, REQUEST *request, char const *in)
+{
+	rlm_sql_t const	*sql_inst = state->inst->sql_inst;
+	size_t		len = (strlen(in) * 3) + 1;
+	char		*out;
+
+	MEM(out = talloc_array(state, char, len));
+	(sql_inst->sql_escape_func)(request, out, len, in, state->handle);
+
+	return out;
+}
+
+/* assign new IP address, if required
+ *
+ * Each attempt to reserve an address is a single batch, so allocations
+ * normally need one round trip to the database.
+ */
 static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	VALUE_PAIR *vp;
 	char const *pname;       /* name of requested IP pool */
 	uint32_t nasip;	     /* NAS IP in host byte order */
-	struct in_addr ip = {0};    /* reserved IP for client (net. byte order) */
-	rlm_sql_handle_t *sqlsock;
-	unsigned long s_gid,	/* _s_elected in sql result set */
-		      s_prio,      /* as above */
-		      s_pid,	/* as above */
-		      gid,	  /* real integer value */
-		      pid,	  /* as above */
-		      weights_sum, used_sum, ip_start, ip_stop, connid;
-	long prio;
-	rlm_sql_row_t row;
+	nvp_async_t *state;
 
 	rlm_sqlhpwippool_t	*inst = (rlm_sqlhpwippool_t *) instance;
 
@@ -338,259 +724,27 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *t
 	}
 
 	/* get our database connection */
-	sqlsock = fr_pool_connection_get(inst->sql_inst->pool, request);
-	if (!sqlsock) {
+	state = nvp_async_alloc(inst, request, NVP_OP_ALLOC);
+	if (!state) {
 		RERROR("Error while requesting an SQL socket");
 		return RLM_MODULE_FAIL;
 	}
 
-	/* get connection id as temporary unique integer */
-	if (nvp_select(&row, inst, sqlsock, "SELECT CONNECTION_ID()") < 1) {
-		REDEBUG("Failed getting connection ID");
-		nvp_select_finish(inst, sqlsock);
-		fr_pool_connection_release(inst->sql_inst->pool, request, sqlsock);
-		return RLM_MODULE_FAIL;
-	}
-
-	connid = strtoul(row[0], (char **) NULL, 10);
-	nvp_select_finish(inst, sqlsock);
-
-	/* synchronize with radacct db, if needed */
-	if (++inst->sincesync >= inst->sync_after
-#ifdef HAVE_PTHREAD_D
-	    && (pthread_mutex_trylock(&inst->mutex)) == 0
-#endif
-	   ) {
-		int r;
+	state->pname = nvp_escape(state, request, pname);
+	state->nasip = nasip;
 
+	if (++inst->sincesync >= inst->sync_after) {
 		inst->sincesync = 0;
-
-		RDEBUG2("Syncing with radacct table");
-
-		r = (nvp_freeclosed(inst, sqlsock) && nvp_syncfree(inst, sqlsock));
-
-#ifdef HAVE_PTHREAD_D
-		pthread_mutex_unlock(&inst->mutex);
-#endif
-
-		if (!r) {
-			RERROR("Synchronization failed");
-			fr_pool_connection_release(inst->sql_inst->pool, request, sqlsock);
-			return RLM_MODULE_FAIL;
-		}
+		state->sync = true;
 	}
 
-	for (s_gid = 0; s_gid < RLM_NETVIM_MAX_ROWS && !(ip.s_addr); s_gid++) {
-		RDEBUG2("Selecting gid on position %lu", s_gid);
-
-		/* find the most specific group which NAS belongs to */
-		switch (nvp_select(&row, inst, sqlsock,
-		       "SELECT `host_groups`.`gid` "
-			"FROM "
-				"`%s`.`host_groups`, "
-				"`%1$s`.`gid_ip`, "
-				"`%1$s`.`ids` "
-			"WHERE "
-				"`host_groups`.`gid` = `ids`.`id` AND "
-				"`ids`.`enabled` = 1 AND "
-				"`host_groups`.`gid` = `gid_ip`.`gid` AND "
-				"%lu BETWEEN `gid_ip`.`ip_start` AND `gid_ip`.`ip_stop` "
-			"ORDER BY (`gid_ip`.`ip_stop` - `gid_ip`.`ip_start`) ASC "
-			"LIMIT %lu, 1",
-		       inst->db_name, nasip, s_gid)) {
-		case -1:
-			RERROR("Couldn't find any more matching host groups");
-			goto end_gid;		  /* exit the main loop */
-
-		case 0:
-			fr_pool_connection_release(inst->sql_inst->pool, request, sqlsock);
-			return RLM_MODULE_FAIL;
-		}
-
-		/* store the group ID and free memory occupied by results */
-		gid = strtoul(row[0], (char **) NULL, 10);
-		nvp_select_finish(inst, sqlsock);
-
-		for (s_prio = 0; s_prio < RLM_NETVIM_MAX_ROWS && !(ip.s_addr); s_prio++) {
-			REDEBUG2("Selecting prio on position %lu", s_prio);
-
-			/* prepare to search for best fit pool */
-			switch (nvp_select(&row, inst, sqlsock,
-				"SELECT "
-					"`ip_pools`.`prio`, "
-					"SUM(`ip_pools`.`weight`) AS `weights_sum`, "
-					"(SUM(`ip_pools`.`total`) - "
-						"SUM(`ip_pools`.`free`)) AS `used_sum` "
-					"FROM "
-						"`%s`.`ip_pools`, "
-						"`%1$s`.`ids`, "
-						"`%1$s`.`pool_names` "
-					"WHERE "
-						"`ip_pools`.`gid` = %lu AND "
-						"`ids`.`id` = `ip_pools`.`pid` AND "
-						"`ids`.`enabled` = 1 AND "
-						"`pool_names`.`pnid` = `ip_pools`.`pnid` AND "
-						"`pool_names`.`name` = '%s' AND "
-						"`ip_pools`.`free` > 0 "
-					"GROUP BY `prio` "
-					"ORDER BY `prio` ASC "
-					"LIMIT %lu, 1",
-				inst->db_name, gid, pname, s_prio)) {
-			case -1:
-				RDEBUG2("Couldn't find any more matching pools for gid = %lu", gid);
-				goto end_prio;	       /* select next gid */
-
-			case 0:
-				fr_pool_connection_release(inst->sql_inst->pool, request, sqlsock);
-				return RLM_MODULE_FAIL;
-			}
-
-			/* store the prio and weights sum */
-			prio = strtol(row[0], (char **) NULL, 10);
-			weights_sum = strtoul(row[1], (char **) NULL, 10);
-			used_sum = strtoul(row[2], (char **) NULL, 10);
-
-			/* free memory */
-			nvp_select_finish(inst, sqlsock);
-
-			for (s_pid = 0; s_pid < RLM_NETVIM_MAX_ROWS && !(ip.s_addr); s_pid++) {
-				RDEBUG2("Selecting PID on position %lu", s_pid);
-
-				/* search for best fit pool */
-				switch (nvp_select(&row, inst, sqlsock,
-					"SELECT "
-						"`ip_pools`.`pid`, "
-						"`ip_pools`.`ip_start`, "
-						"`ip_pools`.`ip_stop` "
-						"FROM "
-							"`%s`.`ip_pools`, "
-							"`%1$s`.`ids`, "
-							"`%1$s`.`pool_names` "
-						"WHERE "
-							"`ip_pools`.`gid` = %lu AND "
-							"`ids`.`id` = `ip_pools`.`pid` AND "
-							"`ids`.`enabled` = 1 AND "
-							"`pool_names`.`pnid` = `ip_pools`.`pnid` AND "
-							"`pool_names`.`name` = '%s' AND "
-							"`ip_pools`.`free` > 0 AND "
-							"`prio` = %ld "
-						"ORDER BY (`weight`/%lu.0000 - (`total` - `free`)/%lu) DESC "
-						"LIMIT %lu, 1",
-					inst->db_name, gid, pname, prio,
-					weights_sum, used_sum, s_pid)) {
-				case -1:
-					RDEBUG2("Couldn't find any more matching pools of prio = %ld for gid = %lu",
-						prio, gid);
-					goto end_pid;	      /* select next prio */
-
-				case 0:
-					fr_pool_connection_release(inst->sql_inst->pool, request, sqlsock);
-					return RLM_MODULE_FAIL;
-				}
-
-				/* store the inst and free memory occupied by results */
-				pid = strtoul(row[0], (char **) NULL, 10);
-				ip_start = strtoul(row[1], (char **) NULL, 10);
-				ip_stop = strtoul(row[2], (char **) NULL, 10);
-				nvp_select_finish(inst, sqlsock);
-
-				/* reserve an IP address */
-				if (!nvp_query(inst, sqlsock,
-				    "UPDATE `%s`.`ips` "
-					"SET "
-						"`pid` = %lu, "
-						"`rsv_since` = NOW(), "
-						"`rsv_by` = '" RLM_NETVIM_TMP_PREFIX "%lu', "
-						"`rsv_until` = NOW() + INTERVAL %d SECOND "
-					"WHERE "
-						"`ip` BETWEEN %lu AND %lu AND "
-						"("
-							"`pid` IS NULL OR "
-							"(`rsv_until` > 0 AND `rsv_until` < NOW())"
-						") "
-					"ORDER BY RAND() "
-					"LIMIT 1",
-				    inst->db_name, pid, connid, inst->free_after, ip_start, ip_stop)) {
-					fr_pool_connection_release(inst->sql_inst->pool, request, sqlsock);
-					return RLM_MODULE_FAIL;
-				}
-				else {
-					nvp_finish(inst, sqlsock);
-				}
-
-				/* select assigned IP address */
-				switch (nvp_select(&row, inst, sqlsock,
-					"SELECT `ip` "
-						"FROM `%s`.`ips` "
-						"WHERE `rsv_by` = '" RLM_NETVIM_TMP_PREFIX "%lu' "
-						"ORDER BY `rsv_since` DESC "
-						"LIMIT 1",
-					inst->db_name, connid)) {
-				case -1:
-					RERROR("Couldn't reserve an IP address from pool of pid = %lu "
-					       "(prio = %ld, gid = %lu)", pid, prio, gid);
-					continue;			    /* select next pid */
-
-				case 0:
-					fr_pool_connection_release(inst->sql_inst->pool, request, sqlsock);
-					return RLM_MODULE_FAIL;
-				}
-
-				/* update free IPs count */
-				if (!nvp_query(inst, sqlsock,
-				    "UPDATE `%s`.`ip_pools` "
-					"SET "
-						"`free` = `free` - 1 "
-					"WHERE "
-						"`pid` = %lu "
-				"LIMIT 1",
-				    inst->db_name, pid)) {
-					fr_pool_connection_release(inst->sql_inst->pool, request, sqlsock);
-					return RLM_MODULE_FAIL;
-				}
-				else {
-					nvp_finish(inst, sqlsock);
-				}
-
-				/* get assigned IP and free memory */
-				ip.s_addr = htonl(strtoul(row[0], (char **) NULL, 10));
-				nvp_select_finish(inst, sqlsock);
-			} /* pid */
-end_pid: continue;	   /* stupid */
-		} /* prio */
-end_prio: continue;	  /* stupid */
-	} /* gid */
-end_gid:
-
-	/* release SQL socket */
-fr_pool_connection_release(inst->sql_inst->pool, request, sqlsock);
-
-	/* no free IP address found */
-	if (!ip.s_addr) {
-		RINFO("No free IP address found!");
-
-		if (inst->no_free_fail) {
-			RDEBUG2("Rejecting user");
-			return RLM_MODULE_REJECT;
-		}
-		else {
-			RDEBUG2("Exiting");
-			return RLM_MODULE_NOOP;
-		}
-	}
-
-	/* add IP address to reply packet */
-	vp = radius_pair_create(request->reply, &request->reply->vps, FR_FRAMED_IP_ADDRESS, 0);
-	vp->vp_ipv4addr = ip.s_addr;
-
-	RDEBUG2("Returning %s", inet_ntoa(ip));
-	return RLM_MODULE_OK;
+	return nvp_send(request, state);
 }
 
 static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	VALUE_PAIR *vp;
-	rlm_sql_handle_t *sqlsock;
+	nvp_async_t *state;
 	struct in_addr nasip;      /* NAS IP */
 	char const *sessid;     /* unique session id */
 	char nasipstr[16];	 /* NAS IP in string format */
@@ -627,52 +781,42 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 	}
 
 	/* connect to database */
-	sqlsock = fr_pool_connection_get(inst->sql_inst->pool, request);
-	if (!sqlsock) {
+	state = nvp_async_alloc(inst, request, NVP_OP_ACCT);
+	if (!state) {
 		REDEBUG("Couldn't connect to database");
 		return RLM_MODULE_FAIL;
 	}
 
-
 	switch (acct_type) {
 	case FR_STATUS_START:
 	case FR_STATUS_ALIVE:
 		vp = fr_pair_find_by_num(request->packet->vps, 0, FR_FRAMED_IP_ADDRESS, TAG_ANY);
 		if (!vp) {
 			REDEBUG("No framed IP");
-			fr_pool_connection_release(inst->sql_inst->pool, request, sqlsock);
-			return RLM_MODULE_FAIL;
+			return nvp_done(request, state, RLM_MODULE_FAIL);
 		}
 
 		framedip = ntohl(vp->vp_ipv4addr);
 
-		if (!nvp_query(inst, sqlsock,
+		state->query = talloc_asprintf(state,
 		    "UPDATE `%s`.`ips` "
 			"SET "
 				"`rsv_until` = 0, "
 				"`rsv_by` = '%s' "
 			"WHERE `ip` = %lu",
-		    inst->db_name, sessid, framedip)) {
-			fr_pool_connection_release(inst->sql_inst->pool, request, sqlsock);
-			return RLM_MODULE_FAIL;
-		}
-		nvp_finish(inst, sqlsock);
+		    inst->db_name, nvp_escape(state, request, sessid), (unsigned long) framedip);
 		break;
 
 	case FR_STATUS_STOP:
-		if (!nvp_query(inst, sqlsock,
-		    "UPDATE `%s`.`ips`, `%1$s`.`ip_pools` "
+		state->query = talloc_asprintf(state,
+		    "UPDATE `%1$s`.`ips`, `%1$s`.`ip_pools` "
 			"SET "
-				"`ips`.`rsv_until` = NOW() + INTERVAL %u SECOND, "
+				"`ips`.`rsv_until` = NOW() + INTERVAL %2$u SECOND, "
 				"`ip_pools`.`free` = `ip_pools`.`free` + 1 "
 			"WHERE "
-				"`ips`.`rsv_by` = '%s' AND "
+				"`ips`.`rsv_by` = '%3$s' AND "
 				"`ips`.`ip` BETWEEN `ip_pools`.`ip_start` AND `ip_pools`.`ip_stop`",
-		    inst->db_name, inst->free_after, sessid)) {
-			fr_pool_connection_release(inst->sql_inst->pool, request, sqlsock);
-			return RLM_MODULE_FAIL;
-		}
-		nvp_finish(inst, sqlsock);
+		    inst->db_name, inst->free_after, nvp_escape(state, request, sessid));
 		break;
 
 	case FR_STATUS_ACCOUNTING_OFF:
@@ -680,30 +824,25 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 		vp = fr_pair_find_by_num(request->packet->vps, 0, FR_NAS_IP_ADDRESS, TAG_ANY);
 		if (!vp) {
 			REDEBUG("No NAS IP");
-			fr_pool_connection_release(inst->sql_inst->pool, request, sqlsock);
-			return RLM_MODULE_FAIL;
+			return nvp_done(request, state, RLM_MODULE_FAIL);
 		}
 
 		nasip.s_addr = vp->vp_ipv4addr;
 		strlcpy(nasipstr, inet_ntoa(nasip), sizeof(nasipstr));
 
-		if (!nvp_query(inst, sqlsock,
+		state->query = talloc_asprintf(state,
 		    "UPDATE `%s`.`ips`, `radacct` "
 			"SET `ips`.`rsv_until` = NOW() + INTERVAL %u SECOND "
 			"WHERE "
 				"`radacct`.`nasipaddress` = '%s' AND "
 				"`ips`.`rsv_by` = `radacct`.`acctuniqueid`",
-		    inst->db_name, inst->free_after, nasipstr)) {
-			fr_pool_connection_release(inst->sql_inst->pool, request, sqlsock);
-			return RLM_MODULE_FAIL;
-		}
-		nvp_finish(inst, sqlsock);
-
+		    inst->db_name, inst->free_after, nasipstr);
 		break;
 	}
 
-	fr_pool_connection_release(inst->sql_inst->pool, request, sqlsock);
-	return RLM_MODULE_OK;
+	if (!state->query) return nvp_done(request, state, RLM_MODULE_FAIL);
+
+	return nvp_send(request, state);
 }
 
 extern rad_module_t rlm_sqlhpwippool;
@@ -36,6 +36,20 @@ RCSID("$Id$")
 
 #define MAX_QUERY_LEN 4096
 
+typedef struct {
+	char		addr[FR_IPADDR_PREFIX_STRLEN];
+} sqlippool_addr_t;
+
+/** Addresses claimed in advance from a single pool
+ *
+ */
+typedef struct {
+	char const	*name;			//!< Pool-Name the addresses were claimed from.
+	sqlippool_addr_t *addrs;		//!< Claimed addresses not yet allocated.
+	uint32_t	num;			//!< Number of entries in addrs.
+	time_t		expires;		//!< When the claims must no longer be relied on.
+} sqlippool_prefetch_t;
+
 /*
  *	Define a structure for our module configuration.
  */
@@ -59,6 +73,18 @@ typedef struct rlm_sqlippool_t {
 
 	char const	*pool_check;		//!< Query to check for the existence of the pool.
 
+						/* Prefetch sequence */
+	uint32_t	prefetch_size;		//!< How many addresses to claim at once.
+	char const	*prefetch_owner;	//!< Marks the addresses claimed by this server.
+	char const	*prefetch_find;		//!< SQL query to find unused IPs to claim.
+	char const	*prefetch_claim;	//!< SQL query to claim an IP.
+	char const	*prefetch_update;	//!< SQL query to mark a claimed IP as used.
+	char const	*prefetch_release;	//!< SQL query to release claims left by a previous run.
+
+	rbtree_t	*prefetch_tree;		//!< Claimed addresses, by pool name.
+	pthread_mutex_t	prefetch_mutex;		//!< Protects prefetch_tree and prefetch_reconciled.
+	bool		prefetch_reconciled;	//!< Whether prefetch_release has been run.
+
 						/* Start sequence */
 	char const	*start_begin;		//!< SQL query to begin.
 	char const	*start_update;		//!< SQL query to update an IP entry.
@@ -131,6 +157,19 @@ static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("pool_check", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, pool_check), .dflt = "" },
 
 
+	{ FR_CONF_OFFSET("prefetch_size", FR_TYPE_UINT32, rlm_sqlippool_t, prefetch_size), .dflt = "0" },
+
+	{ FR_CONF_OFFSET("prefetch_owner", FR_TYPE_STRING, rlm_sqlippool_t, prefetch_owner) },
+
+	{ FR_CONF_OFFSET("prefetch_find", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, prefetch_find), .dflt = "" },
+
+	{ FR_CONF_OFFSET("prefetch_claim", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, prefetch_claim), .dflt = "" },
+
+	{ FR_CONF_OFFSET("prefetch_update", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, prefetch_update), .dflt = "" },
+
+	{ FR_CONF_OFFSET("prefetch_release", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, prefetch_release), .dflt = "" },
+
+
 	{ FR_CONF_OFFSET("start_begin", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, start_begin), .dflt = "START TRANSACTION" },
 
 	{ FR_CONF_OFFSET("start_update", FR_TYPE_STRING | FR_TYPE_XLAT , rlm_sqlippool_t, start_update), .dflt = "" },
@@ -256,7 +295,7 @@ static int sqlippool_expand(char * out, int outlen, char const * fmt,
  * @param param ip address string.
  * @param param_len ip address string len.
  * @return
- *	- 0 on success.
+ *	- >= 0 on success, the number of rows affected.
  *	- < 0 on error.
  */
 static int sqlippool_command(char const *fmt, rlm_sql_handle_t **handle,
@@ -287,8 +326,12 @@ static int sqlippool_command(char const *fmt, rlm_sql_handle_t **handle,
 	}
 	talloc_free(expanded);
 
-	if (*handle) (data->sql_inst->driver->sql_finish_query)(*handle, data->sql_inst->config);
-	return 0;
+	if (!*handle) return 0;
+
+	ret = (data->sql_inst->driver->sql_affected_rows)(*handle, data->sql_inst->config);
+	(data->sql_inst->driver->sql_finish_query)(*handle, data->sql_inst->config);
+
+	return ret < 0 ? 0 : ret;
 }
 
 /*
@@ -362,6 +405,216 @@ finish:
 	return retval;
 }
 
+static int sqlippool_prefetch_cmp(void const *one, void const *two)
+{
+	sqlippool_prefetch_t const *a = one, *b = two;
+
+	return strcmp(a->name, b->name);
+}
+
+/** Release the claims left behind by a previous run of this server
+ *
+ * Must complete before this run claims anything, as the claims can't
+ * be told apart.
+ */
+static void sqlippool_prefetch_reconcile(rlm_sqlippool_t *inst, REQUEST *request, rlm_sql_handle_t **handle)
+{
+	int released;
+
+	pthread_mutex_lock(&inst->prefetch_mutex);
+	if (inst->prefetch_reconciled) {
+		pthread_mutex_unlock(&inst->prefetch_mutex);
+		return;
+	}
+
+	released = sqlippool_command(inst->prefetch_release, handle, inst, request, NULL, 0);
+	if (released < 0) {
+		pthread_mutex_unlock(&inst->prefetch_mutex);
+		RWDEBUG("Failed releasing addresses claimed by a previous run, will retry");
+		return;
+	}
+	inst->prefetch_reconciled = true;
+	pthread_mutex_unlock(&inst->prefetch_mutex);
+
+	if (released > 0) RDEBUG("Released %i address(es) claimed by a previous run", released);
+}
+
+/** Take a claimed address for the pool, if there is one
+ *
+ * @return
+ *	- The length of the address written to out.
+ *	- 0 if there are no usable claimed addresses.
+ */
+static int sqlippool_prefetch_pop(char *out, size_t outlen, rlm_sqlippool_t *inst, char const *pool_name)
+{
+	sqlippool_prefetch_t	find, *pool;
+	int			len = 0;
+
+	find.name = pool_name;
+
+	pthread_mutex_lock(&inst->prefetch_mutex);
+	pool = rbtree_finddata(inst->prefetch_tree, &find);
+	if (pool) {
+		/*
+		 *	Claims past their expiry may already have
+		 *	been taken by another server.
+		 */
+		if (pool->expires <= time(NULL)) pool->num = 0;
+
+		if (pool->num > 0) {
+			pool->num--;
+			len = strlcpy(out, pool->addrs[pool->num].addr, outlen);
+		}
+	}
+	pthread_mutex_unlock(&inst->prefetch_mutex);
+
+	return len;
+}
+
+/** Claim a block of free addresses from the pool
+ *
+ * Runs prefetch_find to select up to prefetch_size free addresses, and
+ * prefetch_claim for each, within a single transaction.  Addresses
+ * claimed successfully are added to the pool's free list.
+ *
+ * @return
+ *	- The number of addresses claimed.
+ *	- < 0 on error.
+ */
+static int sqlippool_prefetch_fill(rlm_sqlippool_t *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				   char const *pool_name)
+{
+	char			query[MAX_QUERY_LEN];
+	char			*expanded = NULL;
+	sqlippool_addr_t	*found;
+	uint32_t		i, num_found = 0, num_claimed = 0;
+	rlm_sql_row_t		row;
+	sqlippool_prefetch_t	find, *pool;
+	time_t			expires;
+
+	sqlippool_prefetch_reconcile(inst, request, handle);
+	if (!*handle) return -1;
+
+	found = talloc_array(request, sqlippool_addr_t, inst->prefetch_size);
+	if (!found) return -1;
+
+	expires = time(NULL) + (inst->lease_duration / 2);
+
+	sqlippool_command(inst->allocate_begin, handle, inst, request, NULL, 0);
+	if (!*handle) goto error;
+
+	sqlippool_expand(query, sizeof(query), inst->prefetch_find, inst, NULL, 0);
+	if (xlat_aeval(request, &expanded, request, query, inst->sql_inst->sql_escape_func, *handle) < 0) goto error;
+
+	if (inst->sql_inst->sql_select_query(inst->sql_inst, request, handle, expanded) != RLM_SQL_OK) {
+		talloc_free(expanded);
+		goto error;
+	}
+	talloc_free(expanded);
+
+	while ((num_found < inst->prefetch_size) &&
+	       (inst->sql_inst->sql_fetch_row(&row, inst->sql_inst, request, handle) == RLM_SQL_OK) && row) {
+		if (!row[0] || !*row[0]) continue;
+
+		if (strlcpy(found[num_found].addr, row[0], sizeof(found[0].addr)) >= sizeof(found[0].addr)) {
+			RWDEBUG("Ignoring invalid address \"%s\"", row[0]);
+			continue;
+		}
+		num_found++;
+	}
+	if (*handle) (inst->sql_inst->driver->sql_finish_select_query)(*handle, inst->sql_inst->config);
+
+	/*
+	 *	Claim in place, so the list only holds the addresses
+	 *	we now own.
+	 */
+	for (i = 0; i < num_found; i++) {
+		int claimed;
+
+		claimed = sqlippool_command(inst->prefetch_claim, handle, inst, request,
+					    found[i].addr, strlen(found[i].addr));
+		if (claimed < 0) goto error;
+		if (claimed == 0) continue;
+
+		if (i != num_claimed) found[num_claimed] = found[i];
+		num_claimed++;
+	}
+
+	sqlippool_command(inst->allocate_commit, handle, inst, request, NULL, 0);
+
+	RDEBUG2("Claimed %u address(es) from pool \"%s\"", num_claimed, pool_name);
+
+	if (!num_claimed) goto done;
+
+	pthread_mutex_lock(&inst->prefetch_mutex);
+	find.name = pool_name;
+	pool = rbtree_finddata(inst->prefetch_tree, &find);
+	if (!pool) {
+		MEM(pool = talloc_zero(inst->prefetch_tree, sqlippool_prefetch_t));
+		pool->name = talloc_typed_strdup(pool, pool_name);
+		MEM(pool->addrs = talloc_array(pool, sqlippool_addr_t, inst->prefetch_size));
+		rbtree_insert(inst->prefetch_tree, pool);
+	}
+
+	/*
+	 *	Another request may have filled the list while we were
+	 *	claiming.  Anything that doesn't fit is left to expire.
+	 */
+	if (pool->expires <= time(NULL)) pool->num = 0;
+
+	/*
+	 *	The list expires with its oldest claims.
+	 */
+	if (!pool->num) pool->expires = expires;
+
+	for (i = 0; (i < num_claimed) && (pool->num < inst->prefetch_size); i++) {
+		pool->addrs[pool->num++] = found[i];
+	}
+	pthread_mutex_unlock(&inst->prefetch_mutex);
+
+done:
+	talloc_free(found);
+	return num_claimed;
+
+error:
+	if (*handle) sqlippool_command(inst->allocate_commit, handle, inst, request, NULL, 0);
+	talloc_free(found);
+	return -1;
+}
+
+/** Allocate an address from the addresses claimed in advance
+ *
+ * Claimed addresses are only marked as used, with prefetch_update,
+ * which doesn't contend with other servers for the pool.  If the
+ * update doesn't match, the claim has been lost, and the next address
+ * is tried.
+ *
+ * @return
+ *	- The length of the address written to out.
+ *	- 0 if no address could be allocated.
+ */
+static int sqlippool_prefetch_allocate(char *out, size_t outlen, rlm_sqlippool_t *inst, REQUEST *request,
+				       rlm_sql_handle_t **handle, char const *pool_name)
+{
+	int	len, updated;
+	bool	filled = false;
+
+	for (;;) {
+		len = sqlippool_prefetch_pop(out, outlen, inst, pool_name);
+		if (!len) {
+			if (filled || (sqlippool_prefetch_fill(inst, request, handle, pool_name) <= 0)) return 0;
+			filled = true;
+			continue;
+		}
+
+		updated = sqlippool_command(inst->prefetch_update, handle, inst, request, out, len);
+		if (updated > 0) return len;
+		if (updated < 0) return 0;
+
+		RDEBUG2("Claim on %s has been lost", out);
+	}
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -399,12 +652,41 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 	inst->sql_inst = (rlm_sql_t *) sql_inst->dl_inst->data;
 
-	if (strcmp(inst->sql_inst->driver->name, "sql") != 0) {
+	if (strcmp(sql_inst->module->name, "sql") != 0) {
 		cf_log_err(conf, "Module \"%s\" is not an instance of the rlm_sql module",
 			      inst->sql_instance_name);
 		return -1;
 	}
 
+	if (inst->prefetch_size) {
+		if (!*inst->prefetch_find || !*inst->prefetch_claim || !*inst->prefetch_update) {
+			cf_log_err(conf, "\"prefetch_find\", \"prefetch_claim\" and \"prefetch_update\" "
+				   "must be set if \"prefetch_size\" is > 0");
+			return -1;
+		}
+
+		if (!inst->prefetch_owner || !*inst->prefetch_owner) {
+			cf_log_err(conf, "\"prefetch_owner\" must be set if \"prefetch_size\" is > 0");
+			return -1;
+		}
+
+		inst->prefetch_tree = rbtree_create(inst, sqlippool_prefetch_cmp, NULL, RBTREE_FLAG_NONE);
+		if (!inst->prefetch_tree) {
+			cf_log_err(conf, "Failed creating prefetch tree");
+			return -1;
+		}
+		pthread_mutex_init(&inst->prefetch_mutex, NULL);
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_sqlippool_t *inst = instance;
+
+	if (inst->prefetch_tree) pthread_mutex_destroy(&inst->prefetch_mutex);
+
 	return 0;
 }
 
@@ -439,7 +721,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *t
 	rlm_sqlippool_t *inst = instance;
 	char allocation[FR_MAX_STRING_LEN];
 	int allocation_len;
-	VALUE_PAIR *vp;
+	VALUE_PAIR *vp, *pool_name;
 	rlm_sql_handle_t *handle;
 	time_t now;
 
@@ -452,7 +734,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *t
 		return do_logging(request, inst->log_exists, RLM_MODULE_NOOP);
 	}
 
-	if (fr_pair_find_by_num(request->control, 0, FR_POOL_NAME, TAG_ANY) == NULL) {
+	pool_name = fr_pair_find_by_num(request->control, 0, FR_POOL_NAME, TAG_ANY);
+	if (!pool_name) {
 		RDEBUG("No Pool-Name defined");
 
 		return do_logging(request, inst->log_nopool, RLM_MODULE_NOOP);
@@ -484,18 +767,31 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *t
 		DO_PART(allocate_commit);
 	}
 
-	DO_PART(allocate_begin);
+	/*
+	 *	Allocate from the addresses claimed in advance.  The
+	 *	claims are written back individually, so only refilling
+	 *	the list waits on other servers.
+	 */
+	if (inst->prefetch_size) {
+		allocation_len = sqlippool_prefetch_allocate(allocation, sizeof(allocation), inst, request,
+							     &handle, pool_name->vp_strvalue);
+		if (!handle) {
+			REDEBUG("Failed allocating IP address, lost SQL connection");
+			return RLM_MODULE_FAIL;
+		}
+	} else {
+		DO_PART(allocate_begin);
 
-	allocation_len = sqlippool_query1(allocation, sizeof(allocation),
-					  inst->allocate_find, handle,
-					  inst, request, (char *) NULL, 0);
+		allocation_len = sqlippool_query1(allocation, sizeof(allocation),
+						  inst->allocate_find, handle,
+						  inst, request, (char *) NULL, 0);
+		if (allocation_len == 0) DO_PART(allocate_commit);
+	}
 
 	/*
 	 *	Nothing found...
 	 */
 	if (allocation_len == 0) {
-		DO_PART(allocate_commit);
-
 		/*
 		 *Should we perform pool-check ?
 		 */
@@ -549,7 +845,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *t
 	 */
 	vp = fr_pair_afrom_num(request->reply, 0, inst->framed_ip_address);
 	if (fr_pair_value_from_str(vp, allocation, allocation_len) < 0) {
-		DO_PART(allocate_commit);
+		if (!inst->prefetch_size) DO_PART(allocate_commit);
 
 		RDEBUG("Invalid IP number [%s] returned from instbase query.", allocation);
 		fr_pool_connection_release(inst->sql_inst->pool, request, handle);
@@ -560,12 +856,14 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *t
 	fr_pair_add(&request->reply->vps, vp);
 
 	/*
-	 *	UPDATE
+	 *	UPDATE (claimed addresses have already been marked as used)
 	 */
-	sqlippool_command(inst->allocate_update, &handle, inst, request,
-			  allocation, allocation_len);
+	if (!inst->prefetch_size) {
+		sqlippool_command(inst->allocate_update, &handle, inst, request,
+				  allocation, allocation_len);
 
-	DO_PART(allocate_commit);
+		DO_PART(allocate_commit);
+	}
 
 	fr_pool_connection_release(inst->sql_inst->pool, request, handle);
 
@@ -707,6 +1005,7 @@ rad_module_t rlm_sqlippool = {
 	.inst_size	= sizeof(rlm_sqlippool_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_POST_AUTH]		= mod_post_auth
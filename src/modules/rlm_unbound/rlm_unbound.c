@@ -30,6 +30,7 @@ RCSID("$Id$")
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/log.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unbound.h>
 
 typedef struct rlm_unbound_t {
@@ -45,6 +46,14 @@ typedef struct rlm_unbound_t {
 
 	char const	*filename;
 
+	uint32_t	cache_max_entries;	//!< Maximum number of answers each thread caches.
+	uint32_t	cache_max_ttl;		//!< Maximum time to cache an answer for.
+
+	int		log_level;		//!< Passed to ub_ctx_debuglevel().
+	fr_log_dst_t	log_dst;		//!< Where libunbound logs to.
+	bool		log_file_set;		//!< Whether we gave libunbound the server's log file.
+	bool		syslog_override;	//!< Whether we turned off use-syslog.
+
 	int		log_fd;
 	FILE		*log_stream;
 
@@ -53,12 +62,60 @@ typedef struct rlm_unbound_t {
 	bool		log_pipe_in_use;
 } rlm_unbound_t;
 
+typedef struct unbound_cache_entry unbound_cache_entry_t;
+
+/** An answer, or the absence of one
+ *
+ */
+struct unbound_cache_entry {
+	int			rrtype;		//!< Type of the query.
+	char const		*owner;		//!< Name which was queried.
+	char const		*value;		//!< First record in the answer, as a string.
+						//!< NULL if the name doesn't exist, or has
+						//!< no records of this type.
+	time_t			expires;	//!< When the TTL of the answer runs out.
+
+	unbound_cache_entry_t	*prev;		//!< Previous entry, oldest first.
+	unbound_cache_entry_t	*next;		//!< Next entry, oldest first.
+};
+
+/** Each worker thread has its own libunbound context
+ *
+ * The context's fd is serviced by the worker's event list, and queries are
+ * waited for with poll(), so the worker wakes up as soon as the answer
+ * arrives, and doesn't contend with other threads for the context.
+ */
+typedef struct {
+	rlm_unbound_t const	*inst;		//!< Instance of rlm_unbound.
+	fr_event_list_t		*el;		//!< This thread's event list.
+
+	struct ub_ctx		*ub;		//!< This thread's libunbound context.
+	int			fd;		//!< Signalled when answers are available.
+
+	rbtree_t		*cache;		//!< Answers by type and owner.
+	unbound_cache_entry_t	*head;		//!< Oldest entry.
+	unbound_cache_entry_t	*tail;		//!< Newest entry.
+} rlm_unbound_thread_t;
+
+/*
+ *	xlats aren't passed thread specific data, so we keep
+ *	our own index of this thread's contexts.
+ */
+fr_thread_local_setup(rbtree_t *, unbound_thread_tree)	/* macro */
+
+static const CONF_PARSER cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_unbound_t, cache_max_entries), .dflt = "1024" },
+	{ FR_CONF_OFFSET("max_ttl", FR_TYPE_UINT32, rlm_unbound_t, cache_max_ttl), .dflt = "3600" },
+	CONF_PARSER_TERMINATOR
+};
+
 /*
  *	A mapping of configuration file names to internal variables.
  */
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_INPUT | FR_TYPE_REQUIRED, rlm_unbound_t, filename), .dflt = "${modconfdir}/unbound/default.conf" },
 	{ FR_CONF_OFFSET("timeout", FR_TYPE_UINT32, rlm_unbound_t, timeout), .dflt = "3000" },
+	{ FR_CONF_POINTER("cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -150,39 +207,161 @@ static int rrlabels_tostr(char *out, char *rr, size_t left)
 	return offset;
 }
 
-static int ub_common_wait(rlm_unbound_t const *inst, REQUEST *request,
+static int unbound_cache_entry_cmp(void const *one, void const *two)
+{
+	unbound_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->rrtype > b->rrtype) - (a->rrtype < b->rrtype);
+	if (ret != 0) return ret;
+
+	return strcasecmp(a->owner, b->owner);
+}
+
+/** Remove an entry from the cache, and free it
+ *
+ */
+static void unbound_cache_entry_free(rlm_unbound_thread_t *t, unbound_cache_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		t->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		t->tail = entry->prev;
+	}
+
+	rbtree_deletebydata(t->cache, entry);
+	talloc_free(entry);
+}
+
+/** Find an answer which hasn't expired
+ *
+ */
+static unbound_cache_entry_t *unbound_cache_find(rlm_unbound_thread_t *t, int rrtype, char const *owner)
+{
+	unbound_cache_entry_t	*entry, find;
+
+	if (!t->cache) return NULL;
+
+	find.rrtype = rrtype;
+	find.owner = owner;
+
+	entry = rbtree_finddata(t->cache, &find);
+	if (!entry) return NULL;
+
+	if (entry->expires <= time(NULL)) {
+		unbound_cache_entry_free(t, entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+/** Add an answer to the cache
+ *
+ * @param[in] t		Thread the answer was received by.
+ * @param[in] rrtype	of the query.
+ * @param[in] owner	which was queried.
+ * @param[in] value	First record in the answer, or NULL if there were no records.
+ * @param[in] ttl	of the answer.
+ */
+static void unbound_cache_add(rlm_unbound_thread_t *t, int rrtype, char const *owner, char const *value, int ttl)
+{
+	rlm_unbound_t const	*inst = t->inst;
+	unbound_cache_entry_t	*entry, find;
+
+	if (!t->cache || (ttl <= 0)) return;
+	if ((uint32_t)ttl > inst->cache_max_ttl) ttl = inst->cache_max_ttl;
+	if (!ttl) return;
+
+	find.rrtype = rrtype;
+	find.owner = owner;
+
+	entry = rbtree_finddata(t->cache, &find);
+	if (entry) unbound_cache_entry_free(t, entry);
+
+	while (t->head && (rbtree_num_elements(t->cache) >= inst->cache_max_entries)) {
+		unbound_cache_entry_free(t, t->head);
+	}
+
+	entry = talloc_zero(t->cache, unbound_cache_entry_t);
+	if (!entry) return;
+
+	entry->rrtype = rrtype;
+	entry->owner = talloc_typed_strdup(entry, owner);
+	if (value) entry->value = talloc_typed_strdup(entry, value);
+	entry->expires = time(NULL) + ttl;
+
+	if (!rbtree_insert(t->cache, entry)) {
+		talloc_free(entry);
+		return;
+	}
+
+	entry->prev = t->tail;
+	if (t->tail) {
+		t->tail->next = entry;
+	} else {
+		t->head = entry;
+	}
+	t->tail = entry;
+}
+
+/** Wait for an answer to arrive on this thread's context
+ *
+ * The context belongs to this thread, so the only answers arriving on
+ * its fd are ones we're waiting for.
+ */
+static int ub_common_wait(rlm_unbound_thread_t *t, REQUEST *request,
 			  char const *name, struct ub_result **ub, int async_id)
 {
-	useconds_t iv, waited;
+	rlm_unbound_t const	*inst = t->inst;
+	struct timeval		now, end;
 
-	iv = inst->timeout > 64 ? 64000 : inst->timeout * 1000;
-	ub_process(inst->ub);
+	gettimeofday(&end, NULL);
+	end.tv_sec += inst->timeout / 1000;
+	end.tv_usec += (inst->timeout % 1000) * 1000;
+	if (end.tv_usec >= 1000000) {
+		end.tv_sec++;
+		end.tv_usec -= 1000000;
+	}
 
-	for (waited = 0; (void const *)*ub == (void const *)inst; waited += iv, iv *= 2) {
+	ub_process(t->ub);
 
-		if (waited + iv > (useconds_t)inst->timeout * 1000) {
-			usleep(inst->timeout * 1000 - waited);
-			ub_process(inst->ub);
-			break;
-		}
+	while ((void const *)*ub == (void const *)t) {
+		struct pollfd	pfd;
+		int		ms, ret;
+
+		gettimeofday(&now, NULL);
+		ms = ((end.tv_sec - now.tv_sec) * 1000) + ((end.tv_usec - now.tv_usec) / 1000);
+		if (ms <= 0) break;
 
-		usleep(iv);
+		pfd.fd = t->fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
 
-		/* Check if already handled by event loop */
-		if ((void const *)*ub != (void const *)inst) {
+		ret = poll(&pfd, 1, ms);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+
+			REDEBUG("%s - Failed waiting for DNS: %s", name, fr_syserror(errno));
 			break;
 		}
+		if (ret == 0) break;
 
-		/* In case we are running single threaded */
-		ub_process(inst->ub);
+		ub_process(t->ub);
 	}
 
-	if ((void const *)*ub == (void const *)inst) {
+	if ((void const *)*ub == (void const *)t) {
 		int res;
 
 		RDEBUG("%s - DNS took too long", name);
 
-		res = ub_cancel(inst->ub, async_id);
+		res = ub_cancel(t->ub, async_id);
 		if (res) {
 			REDEBUG("%s - ub_cancel: %s", name, ub_strerror(res));
 		}
@@ -212,96 +391,117 @@ static int ub_common_fail(REQUEST *request, char const *name, struct ub_result *
 	return 0;
 }
 
-static ssize_t xlat_a(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
-		      void const *mod_inst, UNUSED void const *xlat_inst,
-		      REQUEST *request, char const *fmt)
+/** Resolve an owner name, returning the first record of the answer as a string
+ *
+ * Answers are cached by the thread until their TTL runs out.
+ */
+static ssize_t ub_common_resolve(rlm_unbound_t const *inst, REQUEST *request, char const *name,
+				 int rrtype, char const *fmt, char *out, size_t outlen)
 {
-	rlm_unbound_t const *inst = mod_inst;
-	struct ub_result **ubres;
-	int async_id;
-	char *fmt2; /* For const warnings.  Keep till new libunbound ships. */
+	rlm_unbound_thread_t	*t, find;
+	unbound_cache_entry_t	*entry;
+	struct ub_result	**ubres;
+	int			async_id, res;
+	char			*fmt2; /* For const warnings.  Keep till new libunbound ships. */
+
+	find.inst = inst;
+	t = unbound_thread_tree ? rbtree_finddata(unbound_thread_tree, &find) : NULL;
+	if (!t) {
+		REDEBUG("%s - No libunbound context for this thread", name);
+		return -1;
+	}
+
+	entry = unbound_cache_find(t, rrtype, fmt);
+	if (entry) {
+		if (!entry->value) {
+			RDEBUG("%s - No records (cached)", name);
+			return -1;
+		}
 
-	/* This has to be on the heap, because threads. */
-	ubres = talloc(inst, struct ub_result *);
+		RDEBUG2("%s - Found cached answer", name);
+		if (strlcpy(out, entry->value, outlen) >= outlen) return -1;
+
+		return strlen(out);
+	}
+
+	/* Allocated separately, as it's written to by the callback. */
+	ubres = talloc(t, struct ub_result *);
 
 	/* Used and thus impossible value from heap to designate incomplete */
-	memcpy(ubres, &mod_inst, sizeof(*ubres));
+	memcpy(ubres, &t, sizeof(*ubres));
 
-	fmt2 = talloc_typed_strdup(inst, fmt);
-	ub_resolve_async(inst->ub, fmt2, 1, 1, ubres, link_ubres, &async_id);
+	fmt2 = talloc_typed_strdup(t, fmt);
+	res = ub_resolve_async(t->ub, fmt2, rrtype, 1, ubres, link_ubres, &async_id);
 	talloc_free(fmt2);
+	if (res) {
+		REDEBUG("%s - ub_resolve_async: %s", name, ub_strerror(res));
+		goto error0;
+	}
 
-	if (ub_common_wait(inst, request, inst->xlat_a_name, ubres, async_id)) {
+	if (ub_common_wait(t, request, name, ubres, async_id)) {
 		goto error0;
 	}
 
 	if (*ubres) {
-		if (ub_common_fail(request, inst->xlat_a_name, *ubres)) {
+		if (ub_common_fail(request, name, *ubres)) {
+			/*
+			 *	Remember names which don't exist, for
+			 *	as long as the negative TTL allows.
+			 */
+			if (!(*ubres)->bogus) unbound_cache_add(t, rrtype, fmt, NULL, (*ubres)->ttl);
 			goto error1;
 		}
 
-		if (!inet_ntop(AF_INET, (*ubres)->data[0], *out, outlen)) {
+		switch (rrtype) {
+		case 1:		/* A */
+			if (!inet_ntop(AF_INET, (*ubres)->data[0], out, outlen)) goto error1;
+			break;
+
+		case 28:	/* AAAA */
+			if (!inet_ntop(AF_INET6, (*ubres)->data[0], out, outlen)) goto error1;
+			break;
+
+		case 12:	/* PTR */
+			if (rrlabels_tostr(out, (*ubres)->data[0], outlen) < 0) goto error1;
+			break;
+
+		default:
 			goto error1;
-		};
+		}
+
+		unbound_cache_add(t, rrtype, fmt, out, (*ubres)->ttl);
 
 		ub_resolve_free(*ubres);
 		talloc_free(ubres);
-		return strlen(*out);
+		return strlen(out);
 	}
 
-	RWDEBUG("%s - No result", inst->xlat_a_name);
+	RWDEBUG("%s - No result", name);
 
- error1:
+error1:
 	ub_resolve_free(*ubres); /* Handles NULL gracefully */
 
- error0:
+error0:
 	talloc_free(ubres);
 	return -1;
 }
 
+static ssize_t xlat_a(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
+		      void const *mod_inst, UNUSED void const *xlat_inst,
+		      REQUEST *request, char const *fmt)
+{
+	rlm_unbound_t const *inst = mod_inst;
+
+	return ub_common_resolve(inst, request, inst->xlat_a_name, 1, fmt, *out, outlen);
+}
+
 static ssize_t xlat_aaaa(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
 			 void const *mod_inst, UNUSED void const *xlat_inst,
 			 REQUEST *request, char const *fmt)
 {
 	rlm_unbound_t const *inst = mod_inst;
-	struct ub_result **ubres;
-	int async_id;
-	char *fmt2; /* For const warnings.  Keep till new libunbound ships. */
-
-	/* This has to be on the heap, because threads. */
-	ubres = talloc(inst, struct ub_result *);
-
-	/* Used and thus impossible value from heap to designate incomplete */
-	memcpy(ubres, &mod_inst, sizeof(*ubres));
-
-	fmt2 = talloc_typed_strdup(inst, fmt);
-	ub_resolve_async(inst->ub, fmt2, 28, 1, ubres, link_ubres, &async_id);
-	talloc_free(fmt2);
-
-	if (ub_common_wait(inst, request, inst->xlat_aaaa_name, ubres, async_id)) {
-		goto error0;
-	}
 
-	if (*ubres) {
-		if (ub_common_fail(request, inst->xlat_aaaa_name, *ubres)) {
-			goto error1;
-		}
-		if (!inet_ntop(AF_INET6, (*ubres)->data[0], *out, outlen)) {
-			goto error1;
-		};
-		ub_resolve_free(*ubres);
-		talloc_free(ubres);
-		return strlen(*out);
-	}
-
-	RWDEBUG("%s - No result", inst->xlat_aaaa_name);
-
-error1:
-	ub_resolve_free(*ubres); /* Handles NULL gracefully */
-
-error0:
-	talloc_free(ubres);
-	return -1;
+	return ub_common_resolve(inst, request, inst->xlat_aaaa_name, 28, fmt, *out, outlen);
 }
 
 static ssize_t xlat_ptr(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
@@ -309,45 +509,8 @@ static ssize_t xlat_ptr(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
 			REQUEST *request, char const *fmt)
 {
 	rlm_unbound_t const *inst = mod_inst;
-	struct ub_result **ubres;
-	int async_id;
-	char *fmt2; /* For const warnings.  Keep till new libunbound ships. */
-
-	/* This has to be on the heap, because threads. */
-	ubres = talloc(inst, struct ub_result *);
-
-	/* Used and thus impossible value from heap to designate incomplete */
-	memcpy(ubres, &mod_inst, sizeof(*ubres));
-
-	fmt2 = talloc_typed_strdup(inst, fmt);
-	ub_resolve_async(inst->ub, fmt2, 12, 1, ubres, link_ubres, &async_id);
-	talloc_free(fmt2);
-
-	if (ub_common_wait(inst, request, inst->xlat_ptr_name,
-			   ubres, async_id)) {
-		goto error0;
-	}
-
-	if (*ubres) {
-		if (ub_common_fail(request, inst->xlat_ptr_name, *ubres)) {
-			goto error1;
-		}
-		if (rrlabels_tostr(*out, (*ubres)->data[0], outlen) < 0) {
-			goto error1;
-		}
-		ub_resolve_free(*ubres);
-		talloc_free(ubres);
-		return strlen(*out);
-	}
 
-	RWDEBUG("%s - No result", inst->xlat_ptr_name);
-
-error1:
-	ub_resolve_free(*ubres);  /* Handles NULL gracefully */
-
-error0:
-	talloc_free(ubres);
-	return -1;
+	return ub_common_resolve(inst, request, inst->xlat_ptr_name, 12, fmt, *out, outlen);
 }
 
 /*
@@ -359,15 +522,31 @@ error0:
  */
 static void ub_fd_handler(UNUSED fr_event_list_t *el, UNUSED int sock, UNUSED int flags, void *ctx)
 {
-	rlm_unbound_t *inst = ctx;
+	rlm_unbound_thread_t *t = ctx;
 	int err;
 
-	err = ub_process(inst->ub);
+	err = ub_process(t->ub);
 	if (err) {
 		ERROR("Async ub_process: %s", ub_strerror(err));
 	}
 }
 
+static int _unbound_thread_cmp(void const *a, void const *b)
+{
+	rlm_unbound_thread_t const *my_a = a, *my_b = b;
+
+	return (my_a->inst > my_b->inst) - (my_a->inst < my_b->inst);
+}
+
+static void _unbound_thread_tree_free(void *arg)
+{
+	rbtree_t *tree = talloc_get_type_abort(arg, rbtree_t);
+
+	talloc_free(tree);
+
+	unbound_thread_tree = NULL;
+}
+
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
 	rlm_unbound_t *inst = instance;
@@ -406,7 +585,6 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 	char k[64]; /* To silence const warns until newer unbound in distros */
 
-	inst->el = process_global_event_list(EVENT_CORRAL_AUX);
 	inst->log_pipe_stream[0] = NULL;
 	inst->log_pipe_stream[1] = NULL;
 	inst->log_fd = -1;
@@ -467,6 +645,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 	res = ub_ctx_debuglevel(inst->ub, log_level);
 	if (res) goto error;
+	inst->log_level = log_level;
 
 	switch (default_log.dst) {
 	case L_DST_STDOUT:
@@ -498,6 +677,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 			if (res) {
 				goto error;
 			}
+			inst->log_file_set = true;
 			log_dst = L_DST_FILES;
 			break;
 		}
@@ -539,6 +719,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		strcpy(v, "no");
 		res = ub_ctx_set_option(inst->ub, k, v);
 		if (res) goto error;
+		inst->syslog_override = true;
 
 		if (log_dst == L_DST_FILES) {
 			char *log_file;
@@ -624,6 +805,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	default:
 		break;
 	}
+	inst->log_dst = log_dst;
 
 	/*
 	 *  Now we need to finalize the context.
@@ -636,15 +818,11 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	strcpy(k, "notar33lsite.foo123.nottld A 127.0.0.1");
 	ub_ctx_data_remove(inst->ub, k);
 
-	inst->log_fd = ub_fd(inst->ub);
-	if (inst->log_fd >= 0) {
-		if (fr_event_fd_insert(inst, inst->el, inst->log_fd, ub_fd_handler, NULL, NULL, inst) < 0) {
-			cf_log_err(conf, "could not insert async fd");
-			inst->log_fd = -1;
-			goto error_nores;
-		}
-
-	}
+	/*
+	 *  Queries are sent using each thread's own context.  This one
+	 *  is only used to check the configuration.
+	 */
+	if (inst->cache_max_entries) FR_INTEGER_BOUND_CHECK("cache.max_ttl", inst->cache_max_ttl, >=, 1);
 
 	return 0;
 
@@ -657,6 +835,140 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return -1;
 }
 
+/** Create a libunbound context for this thread, configured the same way as the instance's
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_unbound_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_unbound_t const	*inst = instance;
+	rlm_unbound_thread_t	*t = thread;
+	char			k[64]; /* To silence const warns until newer unbound in distros */
+	char			*file;
+	int			res;
+
+	t->inst = inst;
+	t->el = el;
+	t->fd = -1;
+
+	t->ub = ub_ctx_create();
+	if (!t->ub) {
+		ERROR("ub_ctx_create failed");
+		return -1;
+	}
+
+	res = ub_ctx_async(t->ub, 1);
+	if (res) goto error;
+
+	res = ub_ctx_debuglevel(t->ub, inst->log_level);
+	if (res) goto error;
+
+	if (inst->log_file_set) {
+		strcpy(k, "logfile:");
+		memcpy(&file, &main_config.log_file, sizeof(file));
+		res = ub_ctx_set_option(t->ub, k, file);
+		if (res) goto error;
+	}
+
+	memcpy(&file, &inst->filename, sizeof(file));
+	res = ub_ctx_config(t->ub, file);
+	if (res) goto error;
+
+	if (inst->syslog_override) {
+		char v[3];
+
+		strcpy(k, "use-syslog:");
+		strcpy(v, "no");
+		res = ub_ctx_set_option(t->ub, k, v);
+		if (res) goto error;
+
+		if (inst->log_file_set) {
+			strcpy(k, "logfile:");
+			memcpy(&file, &main_config.log_file, sizeof(file));
+			res = ub_ctx_set_option(t->ub, k, file);
+			if (res) goto error;
+		}
+	}
+
+	/*
+	 *  libunbound was given a file name, or told where to
+	 *  log, when the instance was created.
+	 */
+	if (inst->log_dst != L_DST_FILES) {
+		res = ub_ctx_debugout(t->ub, inst->log_stream);
+		if (res) goto error;
+	}
+
+	/* Finalize the context, see mod_instantiate() */
+	strcpy(k, "notar33lsite.foo123.nottld A 127.0.0.1");
+	ub_ctx_data_remove(t->ub, k);
+
+	t->fd = ub_fd(t->ub);
+	if (t->fd < 0) {
+		ERROR("Failed getting libunbound fd");
+		return -1;
+	}
+
+	if (fr_event_fd_insert(t, el, t->fd, ub_fd_handler, NULL, NULL, t) < 0) {
+		ERROR("Could not insert async fd: %s", fr_strerror());
+		t->fd = -1;
+		return -1;
+	}
+
+	if (inst->cache_max_entries) {
+		t->cache = rbtree_create(NULL, unbound_cache_entry_cmp, NULL, 0);
+		if (!t->cache) {
+			ERROR("Failed creating cache");
+			return -1;
+		}
+	}
+
+	if (!unbound_thread_tree) {
+		rbtree_t *tree;
+
+		MEM(tree = rbtree_create(NULL, _unbound_thread_cmp, NULL, 0));
+		fr_thread_local_set_destructor(unbound_thread_tree, _unbound_thread_tree_free, tree);
+	}
+	rbtree_insert(unbound_thread_tree, t);
+
+	return 0;
+
+error:
+	ERROR("%s", ub_strerror(res));
+
+	return -1;
+}
+
+static int mod_thread_detach(void *thread)
+{
+	rlm_unbound_thread_t *t = thread;
+
+	if (unbound_thread_tree) rbtree_deletebydata(unbound_thread_tree, t);
+
+	if (t->fd >= 0) {
+		fr_event_fd_delete(t->el, t->fd);
+		t->fd = -1;
+	}
+
+	if (t->ub) {
+		ub_process(t->ub);
+		/* See mod_detach() */
+#if 0
+		ub_ctx_delete(t->ub);
+#endif
+	}
+
+	TALLOC_FREE(t->cache);
+
+	return 0;
+}
+
 static int mod_detach(void *instance)
 {
 	rlm_unbound_t *inst = instance;
@@ -702,5 +1014,8 @@ rad_module_t rlm_unbound = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
-	.detach		= mod_detach
+	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_unbound_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach
 };
@@ -211,6 +211,6 @@ extern rad_module_t rlm_unpack;
 rad_module_t rlm_unpack = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "unpack",
-	.type		= RLM_TYPE_THREAD_SAFE,
+	.type		= RLM_TYPE_THREAD_SAFE | RLM_TYPE_SHADOW_SAFE,
 	.bootstrap	= mod_bootstrap
 };
@@ -140,73 +140,100 @@ int8_t fr_dhcpv4_attr_cmp(void const *a, void const *b)
 	return fr_pair_cmp_by_parent_num_tag(my_a, my_b);
 }
 
-/** Check reveived DHCP request is valid and build RADIUS_PACKET structure if it is
+/** Check a received DHCP packet is valid, without allocating anything
  *
- * @param data pointer to received packet.
- * @param data_len length of received data.
- * @param src_ipaddr source ip address.
- * @param src_port source port address.
- * @param dst_ipaddr destination ip address.
- * @param dst_port destination port address.
+ *  The checks are cheap, so that transports can drop bad packets
+ *  before sending them to a worker.
  *
+ * @param[in] data		pointer to received packet.
+ * @param[in] data_len		length of received data.
+ * @param[out] message_type	the value of the DHCP-Message-Type option.
+ * @param[out] xid		the transaction ID of the packet.
  * @return
- *	- RADIUS_PACKET pointer if valid
- *	- NULL if invalid
+ *	- true if the packet is valid.
+ *	- false if it isn't.
  */
-RADIUS_PACKET *fr_dhcpv4_packet_ok(uint8_t const *data, ssize_t data_len, fr_ipaddr_t src_ipaddr,
-				   uint16_t src_port, fr_ipaddr_t dst_ipaddr, uint16_t dst_port)
+bool fr_dhcpv4_ok(uint8_t const *data, ssize_t data_len, uint8_t *message_type, int *xid)
 {
 	uint32_t	magic;
 	uint8_t const	*code;
-	int		pkt_id;
-	RADIUS_PACKET	*packet;
 	size_t		hlen;
 
 	if (data_len < MIN_PACKET_SIZE) {
 		fr_strerror_printf("DHCP packet is too small (%zu < %d)", data_len, MIN_PACKET_SIZE);
-		return NULL;
+		return false;
 	}
 
 	if (data_len > MAX_PACKET_SIZE) {
 		fr_strerror_printf("DHCP packet is too large (%zx > %d)", data_len, MAX_PACKET_SIZE);
-		return NULL;
+		return false;
 	}
 
 	if (data[1] > 1) {
 		fr_strerror_printf("DHCP can only process ethernet requests, not type %02x", data[1]);
-		return NULL;
+		return false;
 	}
 
 	hlen = data[2];
 	if ((hlen != 0) && (hlen != 6)) {
 		fr_strerror_printf("Ethernet HW length incorrect.  Expected 6 got %zu", hlen);
-		return NULL;
+		return false;
 	}
 
 	memcpy(&magic, data + 236, 4);
 	magic = ntohl(magic);
 	if (magic != DHCP_OPTION_MAGIC_NUMBER) {
 		fr_strerror_printf("BOOTP not supported");
-		return NULL;
+		return false;
 	}
 
 	/*
 	 *	Create unique keys for the packet.
 	 */
 	memcpy(&magic, data + 4, 4);
-	pkt_id = ntohl(magic);
+	*xid = ntohl(magic);
 
 	code = fr_dhcpv4_packet_get_option((dhcp_packet_t const *) data, data_len, FR_DHCPV4_MESSAGE_TYPE);
 	if (!code) {
 		fr_strerror_printf("No message-type option was found in the packet");
-		return NULL;
+		return false;
 	}
 
 	if ((code[1] < 1) || (code[2] == 0) || (code[2] >= DHCP_MAX_MESSAGE_TYPE)) {
 		fr_strerror_printf("Unknown value %d for message-type option", code[2]);
-		return NULL;
+		return false;
 	}
 
+	*message_type = code[2];
+
+	return true;
+}
+
+/** Check reveived DHCP request is valid and build RADIUS_PACKET structure if it is
+ *
+ * @param data pointer to received packet.
+ * @param data_len length of received data.
+ * @param src_ipaddr source ip address.
+ * @param src_port source port address.
+ * @param dst_ipaddr destination ip address.
+ * @param dst_port destination port address.
+ *
+ * @return
+ *	- RADIUS_PACKET pointer if valid
+ *	- NULL if invalid
+ */
+RADIUS_PACKET *fr_dhcpv4_packet_ok(uint8_t const *data, ssize_t data_len, fr_ipaddr_t src_ipaddr,
+				   uint16_t src_port, fr_ipaddr_t dst_ipaddr, uint16_t dst_port)
+{
+	uint8_t		code;
+	int		pkt_id;
+	RADIUS_PACKET	*packet;
+	size_t		hlen;
+
+	if (!fr_dhcpv4_ok(data, data_len, &code, &pkt_id)) return NULL;
+
+	hlen = data[2];
+
 	/* Now that checks are done, allocate packet */
 	packet = fr_radius_alloc(NULL, false);
 	if (!packet) {
@@ -215,7 +242,7 @@ RADIUS_PACKET *fr_dhcpv4_packet_ok(uint8_t const *data, ssize_t data_len, fr_ipa
 	}
 
 	packet->data_len = data_len;
-	packet->code = code[2] | FR_DHCPV4_OFFSET;
+	packet->code = code | FR_DHCPV4_OFFSET;
 	packet->id = pkt_id;
 
 	packet->dst_port = dst_port;
@@ -361,7 +361,6 @@ ssize_t fr_dhcpv4_decode_option(TALLOC_CTX *ctx, vp_cursor_t *cursor,
 {
 	ssize_t			ret;
 	uint8_t const		*p = data;
-	fr_dict_attr_t const	*child;
 
 	FR_PROTO_TRACE("%s called to parse %zu byte(s)", __FUNCTION__, data_len);
 
@@ -369,21 +368,6 @@ ssize_t fr_dhcpv4_decode_option(TALLOC_CTX *ctx, vp_cursor_t *cursor,
 
 	FR_PROTO_HEX_DUMP(NULL, data, data_len);
 
-	/*
-	 *	Stupid hacks until we have protocol specific dictionaries
-	 */
-	parent = fr_dict_attr_child_by_num(parent, FR_VENDOR_SPECIFIC);
-	if (!parent) {
-		fr_strerror_printf("Can't find Vendor-Specific (26)");
-		return -1;
-	}
-
-	parent = fr_dict_attr_child_by_num(parent, DHCP_MAGIC_VENDOR);
-	if (!parent) {
-		fr_strerror_printf("Can't find DHCP vendor");
-		return -1;
-	}
-
 	/*
 	 *	Padding / End of options
 	 */
@@ -408,25 +392,70 @@ ssize_t fr_dhcpv4_decode_option(TALLOC_CTX *ctx, vp_cursor_t *cursor,
 		return -1;
 	}
 
-	child = fr_dict_attr_child_by_num(parent, p[0]);
+	ret = fr_dhcpv4_decode_option_value(ctx, cursor, parent, p[0], data + 2, data[1]);
+	if (ret < 0) return ret;
+
+	ret += 2; /* For header */
+	FR_PROTO_TRACE("decoding option complete, returning %zu byte(s)", ret);
+	return ret;
+}
+
+/** Decode the value of a DHCP option
+ *
+ *  The value isn't limited to 255 bytes, so that options which were
+ *  split into pieces (RFC 3396) can be decoded once they've been
+ *  joined back together.
+ *
+ * @param[in] ctx context to alloc new attributes in.
+ * @param[in,out] cursor Where to write the decoded options.
+ * @param[in] parent The root of the protocol dictionary used to decode DHCP attributes.
+ * @param[in] option code of the option.
+ * @param[in] data the option's value.
+ * @param[in] data_len of the option's value.
+ * @return
+ *	- The number of bytes decoded.
+ *	- <0 on error.
+ */
+ssize_t fr_dhcpv4_decode_option_value(TALLOC_CTX *ctx, vp_cursor_t *cursor,
+				      fr_dict_attr_t const *parent, unsigned int option,
+				      uint8_t const *data, size_t data_len)
+{
+	ssize_t			ret;
+	fr_dict_attr_t const	*child;
+
+	/*
+	 *	Stupid hacks until we have protocol specific dictionaries
+	 */
+	parent = fr_dict_attr_child_by_num(parent, FR_VENDOR_SPECIFIC);
+	if (!parent) {
+		fr_strerror_printf("Can't find Vendor-Specific (26)");
+		return -1;
+	}
+
+	parent = fr_dict_attr_child_by_num(parent, DHCP_MAGIC_VENDOR);
+	if (!parent) {
+		fr_strerror_printf("Can't find DHCP vendor");
+		return -1;
+	}
+
+	child = fr_dict_attr_child_by_num(parent, option);
 	if (!child) {
 		/*
 		 *	Unknown attribute, create an octets type
 		 *	attribute with the contents of the sub-option.
 		 */
-		child = fr_dict_unknown_afrom_fields(ctx, parent, DHCP_MAGIC_VENDOR, p[0]);
+		child = fr_dict_unknown_afrom_fields(ctx, parent, DHCP_MAGIC_VENDOR, option);
 		if (!child) return -1;
 	}
 	FR_PROTO_TRACE("decode context changed %s:%s -> %s:%s",
 		       fr_int2str(dict_attr_types, parent->type, "<invalid>"), parent->name,
 		       fr_int2str(dict_attr_types, child->type, "<invalid>"), child->name);
 
-	ret = decode_value(ctx, cursor, child, data + 2, data[1]);
+	ret = decode_value(ctx, cursor, child, data, data_len);
 	if (ret < 0) {
 		fr_dict_unknown_free(&child);
 		return ret;
 	}
-	ret += 2; /* For header */
-	FR_PROTO_TRACE("decoding option complete, returning %zu byte(s)", ret);
+
 	return ret;
 }
@@ -99,6 +99,7 @@ typedef struct dhcp_packet_t {
 #define DHCP_BASE_ATTR(x) (x & 0xff)
 #define DHCP_UNPACK_OPTION1(x) (((x) & 0xff00) >> 8)
 
+#define FR_DHCPV4_OPTION_OVERLOAD (52)
 #define FR_DHCPV4_MESSAGE_TYPE   (53)
 #define FR_DHCPV4_YOUR_IP_ADDRESS (264)
 #define FR_DHCPV4_SUBNET_MASK    (1)
@@ -115,6 +116,29 @@ typedef struct dhcp_packet_t {
 #  define ETH_ADDR_LEN   6
 #endif
 
+/** Where each option is in a raw DHCP packet
+ *
+ *  Built with one pass over the options field, and over the "file" and
+ *  "sname" fields if they're overloaded.  An option which appears more
+ *  than once is one option split into pieces (RFC 3396), and its
+ *  length is the length of all of the pieces.
+ */
+typedef struct {
+	uint8_t const	*data;					//!< The packet the index refers to.
+	size_t		data_len;				//!< Length of the packet.
+
+	uint16_t	offset[UINT8_MAX + 1];			//!< Of the first instance of each option,
+								///< from the start of the packet.  0 if
+								///< the option isn't in the packet.
+	uint16_t	length[UINT8_MAX + 1];			//!< Of each option's value, over all instances.
+	uint16_t	instances[UINT8_MAX + 1];		//!< How many times each option appears.
+
+	uint8_t		order[UINT8_MAX + 1];			//!< Options, in the order they first appear.
+	int		num;					//!< How many entries there are in "order".
+
+	uint8_t		overload;				//!< Value of the overload option.
+} fr_dhcpv4_option_index_t;
+
 extern char const *dhcp_header_names[];
 extern char const *dhcp_message_types[];
 extern int dhcp_header_sizes[];
@@ -143,6 +167,8 @@ int fr_dhcpv4_udp_packet_send(RADIUS_PACKET *packet);
  */
 int8_t		fr_dhcpv4_attr_cmp(void const *a, void const *b);
 
+bool		fr_dhcpv4_ok(uint8_t const *data, ssize_t data_len, uint8_t *message_type, int *xid);
+
 RADIUS_PACKET	*fr_dhcpv4_packet_ok(uint8_t const *data, ssize_t data_len, fr_ipaddr_t src_ipaddr,
 				   uint16_t src_port, fr_ipaddr_t dst_ipaddr, uint16_t dst_port);
 
@@ -155,6 +181,10 @@ ssize_t		fr_dhcpv4_decode_option(TALLOC_CTX *ctx, vp_cursor_t *cursor,
 					fr_dict_attr_t const *parent, uint8_t const *data, size_t len,
 					void *decoder_ctx);
 
+ssize_t		fr_dhcpv4_decode_option_value(TALLOC_CTX *ctx, vp_cursor_t *cursor,
+					      fr_dict_attr_t const *parent, unsigned int option,
+					      uint8_t const *data, size_t data_len);
+
 /*
  *	encode.c
  */
@@ -164,6 +194,13 @@ ssize_t		fr_dhcpv4_encode_option(uint8_t *out, size_t outlen,
 /*
  *	packet.c
  */
+int		fr_dhcpv4_option_index_init(fr_dhcpv4_option_index_t *index, uint8_t const *data, size_t data_len);
+
+uint8_t const	*fr_dhcpv4_option_index_find(fr_dhcpv4_option_index_t const *index, unsigned int option);
+
+ssize_t		fr_dhcpv4_option_index_value(uint8_t *out, size_t outlen,
+					     fr_dhcpv4_option_index_t const *index, unsigned int option);
+
 uint8_t const	*fr_dhcpv4_packet_get_option(dhcp_packet_t const *packet, size_t packet_size, unsigned int option);
 
 int		fr_dhcpv4_packet_decode(RADIUS_PACKET *packet);
@@ -175,10 +212,32 @@ int		fr_dhcpv4_packet_encode(RADIUS_PACKET *packet);
  *	raw.c
  */
 #include <linux/if_packet.h>
+typedef struct fr_dhcpv4_raw_ring_s fr_dhcpv4_raw_ring_t;
+
 int		fr_dhcpv4_raw_socket_open(struct sockaddr_ll *p_ll, int iface_index);
 
+int		fr_dhcpv4_raw_tx_socket_open(struct sockaddr_ll *link_layer, int if_index);
+
+int		fr_dhcpv4_raw_if_ethernet(uint8_t out[ETH_ADDR_LEN], int sockfd, char const *interface);
+
+ssize_t		fr_dhcpv4_raw_frame_build(uint8_t *out, size_t outlen,
+					  uint8_t const src_mac[ETH_ADDR_LEN], uint8_t const dst_mac[ETH_ADDR_LEN],
+					  fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
+					  fr_ipaddr_t const *dst_ipaddr, uint16_t dst_port,
+					  uint8_t const *data, size_t data_len);
+
 int		fr_dhcpv4_raw_packet_send(int sockfd, struct sockaddr_ll *p_ll, RADIUS_PACKET *packet);
 
+fr_dhcpv4_raw_ring_t *fr_dhcpv4_raw_ring_alloc(TALLOC_CTX *ctx, int sockfd, unsigned int frames);
+
+int		fr_dhcpv4_raw_ring_queue(fr_dhcpv4_raw_ring_t *ring,
+					 uint8_t const src_mac[ETH_ADDR_LEN], uint8_t const dst_mac[ETH_ADDR_LEN],
+					 fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
+					 fr_ipaddr_t const *dst_ipaddr, uint16_t dst_port,
+					 uint8_t const *data, size_t data_len);
+
+int		fr_dhcpv4_raw_ring_flush(fr_dhcpv4_raw_ring_t *ring);
+
 RADIUS_PACKET	*fr_dhcv4_raw_packet_recv(int sockfd, struct sockaddr_ll *p_ll, RADIUS_PACKET *request);
 #endif
 
@@ -28,74 +28,244 @@
 #include <talloc.h>
 #include <freeradius-devel/pair.h>
 #include <freeradius-devel/types.h>
+#include <freeradius-devel/proto.h>
 #include <freeradius-devel/dhcpv4/dhcpv4.h>
 
-/** Retrieve a DHCP option from a raw packet buffer
+typedef int (*option_walk_t)(uint8_t const *data, uint8_t const *option, void *uctx);
+
+/** Call a function for each option in a raw packet
  *
+ *  The options field is walked first, then the "file" field, and
+ *  then the "sname" field, if the overload option says they hold
+ *  options (RFC 2131 Section 4.1).  Padding and the end of option
+ *  markers aren't passed to the callback.
  *
+ * @param[in] data	of the packet.
+ * @param[in] data_len	of the packet.
+ * @param[in] func	to call for each option.
+ * @param[in] uctx	passed to func.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the options are malformed, or func failed.
  */
-uint8_t const *fr_dhcpv4_packet_get_option(dhcp_packet_t const *packet, size_t packet_size, unsigned int option)
+static int option_walk(uint8_t const *data, size_t data_len, option_walk_t func, void *uctx)
 {
-	int overload = 0;
-	int field = DHCP_OPTION_FIELD;
-	size_t where, size;
-	uint8_t const *data;
-
-	where = 0;
-	size = packet_size - offsetof(dhcp_packet_t, options);
-	data = &packet->options[where];
-
-	while (where < size) {
-		if (data[0] == 0) { /* padding */
-			where++;
-			continue;
-		}
+	dhcp_packet_t const	*packet = (dhcp_packet_t const *) data;
+	int			field = DHCP_OPTION_FIELD;
+	uint8_t			overload = 0;
+	uint8_t const		*p, *end;
 
-		if (data[0] == 255) { /* end of options */
+	if (data_len < offsetof(dhcp_packet_t, options)) {
+		fr_strerror_printf("Packet is too small to contain options");
+		return -1;
+	}
+
+	p = packet->options;
+	end = data + data_len;
+
+	for (;;) {
+		/*
+		 *	End of this field.  Move on to the next
+		 *	overloaded one, if there is one.
+		 */
+		if ((p >= end) || (p[0] == 255)) {
 			if ((field == DHCP_OPTION_FIELD) && (overload & DHCP_FILE_FIELD)) {
-				data = packet->file;
-				where = 0;
-				size = sizeof(packet->file);
+				p = packet->file;
+				end = p + sizeof(packet->file);
 				field = DHCP_FILE_FIELD;
 				continue;
+			}
 
-			} else if ((field == DHCP_FILE_FIELD) && (overload & DHCP_SNAME_FIELD)) {
-				data = packet->sname;
-				where = 0;
-				size = sizeof(packet->sname);
+			if ((field != DHCP_SNAME_FIELD) && (overload & DHCP_SNAME_FIELD)) {
+				p = packet->sname;
+				end = p + sizeof(packet->sname);
 				field = DHCP_SNAME_FIELD;
 				continue;
 			}
 
-			return NULL;
+			return 0;
+		}
+
+		if (p[0] == 0) { /* padding */
+			p++;
+			continue;
 		}
 
 		/*
 		 *	We MUST have a real option here.
 		 */
-		if ((where + 2) > size) {
-			fr_strerror_printf("Options overflow field at %u",
-					   (unsigned int) (data - (uint8_t const *) packet));
-			return NULL;
+		if ((p + 2) > end) {
+			fr_strerror_printf("Options overflow field at %u", (unsigned int) (p - data));
+			return -1;
 		}
 
-		if ((where + 2 + data[1]) > size) {
-			fr_strerror_printf("Option length overflows field at %u",
-					   (unsigned int) (data - (uint8_t const *) packet));
-			return NULL;
+		if ((p + 2 + p[1]) > end) {
+			fr_strerror_printf("Option length overflows field at %u", (unsigned int) (p - data));
+			return -1;
 		}
 
-		if (data[0] == option) return data;
-
-		if (data[0] == 52) { /* overload sname and/or file */
-			overload = data[3];
+		/*
+		 *	Only the options field can say where the
+		 *	rest of the options are.
+		 */
+		if ((field == DHCP_OPTION_FIELD) && (p[0] == FR_DHCPV4_OPTION_OVERLOAD) && (p[1] >= 1)) {
+			overload = p[2];
 		}
 
-		where += data[1] + 2;
-		data += data[1] + 2;
+		if (func(data, p, uctx) < 0) return -1;
+
+		p += p[1] + 2;
+	}
+}
+
+static int option_index_add(uint8_t const *data, uint8_t const *option, void *uctx)
+{
+	fr_dhcpv4_option_index_t *index = uctx;
+
+	if (!index->instances[option[0]]) {
+		index->offset[option[0]] = option - data;
+		index->order[index->num++] = option[0];
 	}
 
-	return NULL;
+	index->instances[option[0]]++;
+	index->length[option[0]] += option[1];
+
+	if (option[0] == FR_DHCPV4_OPTION_OVERLOAD) index->overload = option[2];
+
+	return 0;
+}
+
+/** Build an index of the options in a raw packet
+ *
+ *  The packet is walked once.  Lookups with #fr_dhcpv4_option_index_find
+ *  are then constant time, no matter how many options are asked for.
+ *
+ * @param[out] index	to initialise.
+ * @param[in] data	of the packet.  Must stay valid for as long as
+ *			the index is used.
+ * @param[in] data_len	of the packet.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the options are malformed.
+ */
+int fr_dhcpv4_option_index_init(fr_dhcpv4_option_index_t *index, uint8_t const *data, size_t data_len)
+{
+	memset(index, 0, sizeof(*index));
+	index->data = data;
+	index->data_len = data_len;
+
+	return option_walk(data, data_len, option_index_add, index);
+}
+
+/** Find an option using the index
+ *
+ * @param[in] index	of the packet.
+ * @param[in] option	to find.
+ * @return
+ *	- The first instance of the option, starting with its code
+ *	  and length.
+ *	- NULL if the option isn't in the packet.
+ */
+uint8_t const *fr_dhcpv4_option_index_find(fr_dhcpv4_option_index_t const *index, unsigned int option)
+{
+	if ((option == 0) || (option >= 255) || !index->instances[option]) return NULL;
+
+	return index->data + index->offset[option];
+}
+
+typedef struct {
+	uint8_t		code;
+	uint8_t		*out;
+	size_t		outlen;
+	size_t		used;
+} option_concat_t;
+
+static int option_concat(UNUSED uint8_t const *data, uint8_t const *option, void *uctx)
+{
+	option_concat_t *concat = uctx;
+
+	if (option[0] != concat->code) return 0;
+
+	if ((concat->used + option[1]) > concat->outlen) {
+		fr_strerror_printf("Insufficient buffer space for option %u", concat->code);
+		return -1;
+	}
+
+	memcpy(concat->out + concat->used, option + 2, option[1]);
+	concat->used += option[1];
+
+	return 0;
+}
+
+/** Copy the value of an option, joining it together if it was split
+ *
+ *  Options which only appear once are copied as-is.  Options which
+ *  appear more than once are concatenated, as per RFC 3396.
+ *
+ * @param[out] out	Where to write the value.
+ * @param[in] outlen	Length of the output buffer.
+ * @param[in] index	of the packet.
+ * @param[in] option	to copy.
+ * @return
+ *	- The length of the value.
+ *	- -1 if the option isn't in the packet, or the buffer is too small.
+ */
+ssize_t fr_dhcpv4_option_index_value(uint8_t *out, size_t outlen,
+				     fr_dhcpv4_option_index_t const *index, unsigned int option)
+{
+	uint8_t const	*p;
+	option_concat_t	concat;
+
+	p = fr_dhcpv4_option_index_find(index, option);
+	if (!p) {
+		fr_strerror_printf("Option %u not found", option);
+		return -1;
+	}
+
+	if (index->length[option] > outlen) {
+		fr_strerror_printf("Insufficient buffer space for option %u", option);
+		return -1;
+	}
+
+	if (index->instances[option] == 1) {
+		memcpy(out, p + 2, p[1]);
+		return p[1];
+	}
+
+	concat.code = option;
+	concat.out = out;
+	concat.outlen = outlen;
+	concat.used = 0;
+
+	/*
+	 *	The index has already checked the options are well
+	 *	formed, so the only failure is running out of room.
+	 */
+	if (option_walk(index->data, index->data_len, option_concat, &concat) < 0) return -1;
+
+	return concat.used;
+}
+
+/** Retrieve a DHCP option from a raw packet buffer
+ *
+ *  Callers which look up more than one option should build an
+ *  index with #fr_dhcpv4_option_index_init, and use that.
+ *
+ * @param[in] packet		to search.
+ * @param[in] packet_size	of the packet.
+ * @param[in] option		to find.
+ * @return
+ *	- The first instance of the option, starting with its code
+ *	  and length.
+ *	- NULL if the option isn't in the packet, or the options are malformed.
+ */
+uint8_t const *fr_dhcpv4_packet_get_option(dhcp_packet_t const *packet, size_t packet_size, unsigned int option)
+{
+	fr_dhcpv4_option_index_t index;
+
+	if (fr_dhcpv4_option_index_init(&index, (uint8_t const *) packet, packet_size) < 0) return NULL;
+
+	return fr_dhcpv4_option_index_find(&index, option);
 }
 
 int fr_dhcpv4_packet_decode(RADIUS_PACKET *packet)
@@ -106,6 +276,7 @@ int fr_dhcpv4_packet_decode(RADIUS_PACKET *packet)
 	vp_cursor_t cursor;
 	VALUE_PAIR *head = NULL, *vp;
 	VALUE_PAIR *maxms, *mtu;
+	fr_dhcpv4_option_index_t index;
 
 	fr_pair_cursor_init(&cursor, &head);
 	p = packet->data;
@@ -116,10 +287,25 @@ int fr_dhcpv4_packet_decode(RADIUS_PACKET *packet)
 		return -1;
 	}
 
+	/*
+	 *	Find all of the options in one pass.  This also tells
+	 *	us if "sname" and "file" hold options instead of
+	 *	strings.
+	 */
+	if (fr_dhcpv4_option_index_init(&index, packet->data, packet->data_len) < 0) return -1;
+
 	/*
 	 *	Decode the header.
 	 */
 	for (i = 0; i < 14; i++) {
+		/*
+		 *	Overloaded fields are decoded as options.
+		 */
+		if (((i == 12) && (index.overload & DHCP_SNAME_FIELD)) ||
+		    ((i == 13) && (index.overload & DHCP_FILE_FIELD))) {
+			p += dhcp_header_sizes[i];
+			continue;
+		}
 
 		vp = fr_pair_make(packet, NULL, dhcp_header_names[i], NULL, T_OP_EQ);
 		if (!vp) {
@@ -160,6 +346,8 @@ int fr_dhcpv4_packet_decode(RADIUS_PACKET *packet)
 			break;
 
 		case FR_TYPE_IPV4_ADDR:
+			vp->vp_ip.af = AF_INET;
+			vp->vp_ip.prefix = 32;
 			memcpy(&vp->vp_ipv4addr, p, 4);
 			break;
 
@@ -201,31 +389,28 @@ int fr_dhcpv4_packet_decode(RADIUS_PACKET *packet)
 	}
 
 	/*
-	 *	Loop over the options.
-	 */
-
-	/*
-	 * 	Nothing uses tail after this call, if it does in the future
-	 *	it'll need to find the new tail...
+	 *	Loop over the options, in the order they first appear
+	 *	in the packet.  Options which were split into pieces
+	 *	are joined back together before they're decoded.
 	 */
-	{
-		uint8_t const *end;
-		ssize_t len;
-
-		p = packet->data + 240;
-		end = p + (packet->data_len - 240);
+	for (i = 0; i < (size_t) index.num; i++) {
+		uint8_t		code = index.order[i];
+		uint8_t const	*option = packet->data + index.offset[code];
+		uint8_t		buffer[MAX_PACKET_SIZE];
+		uint8_t const	*value = option + 2;
+		ssize_t		len = option[1];
+
+		if (index.instances[code] > 1) {
+			len = fr_dhcpv4_option_index_value(buffer, sizeof(buffer), &index, code);
+			if (len < 0) goto error;
+			value = buffer;
+		}
 
-		/*
-		 *	Loop over all the options data
-		 */
-		while (p < end) {
-			len = fr_dhcpv4_decode_option(packet, &cursor, fr_dict_root(fr_dict_internal),
-						    p, ((end - p) > UINT8_MAX) ? UINT8_MAX : (end - p), NULL);
-			if (len <= 0) {
-				fr_pair_list_free(&head);
-				return len;
-			}
-			p += len;
+		if (fr_dhcpv4_decode_option_value(packet, &cursor, fr_dict_root(fr_dict_internal),
+						  code, value, len) < 0) {
+		error:
+			fr_pair_list_free(&head);
+			return -1;
 		}
 	}
 
@@ -30,6 +30,7 @@
 #include <freeradius-devel/pair.h>
 #include <freeradius-devel/types.h>
 #include <freeradius-devel/proto.h>
+#include <freeradius-devel/net.h>
 #include <freeradius-devel/udpfromto.h>
 #include <freeradius-devel/dhcpv4/dhcpv4.h>
 
@@ -47,6 +48,7 @@
 #ifdef HAVE_LINUX_IF_PACKET_H
 #  include <linux/if_packet.h>
 #  include <linux/if_ether.h>
+#  include <sys/mman.h>
 #endif
 
 #ifndef __MINGW32__
@@ -96,76 +98,348 @@ int fr_dhcpv4_raw_socket_open(struct sockaddr_ll *link_layer, int if_index)
 	return fd;
 }
 
-/** Create the requisite L2/L3 headers, and write a DHCPv4 packet to a raw socket
+/** Open a raw socket which is only used to write packets
  *
- * @param[in] sockfd		to write to.
- * @param[in] link_layer	information, as returned by fr_dhcpv4_raw_socket_open.
- * @param[in] packet		to write.
+ *  The socket doesn't receive anything, so it costs nothing when
+ *  there's traffic on the interface.
+ *
+ * @param[out] link_layer	A sockaddr_ll struct to populate.  Must be passed to other raw
+ *				functions.
+ * @param[in] if_index		of the interface we're binding to.
+ * @return
+ *	- >= 0 a file descriptor to write packets on.
+ *	- <0 an error ocurred.
+ */
+int fr_dhcpv4_raw_tx_socket_open(struct sockaddr_ll *link_layer, int if_index)
+{
+	int fd;
+
+	/*
+	 *	A protocol of 0 means the kernel doesn't give us
+	 *	any packets.
+	 */
+	fd = socket(PF_PACKET, SOCK_RAW, 0);
+	if (fd < 0) {
+		fr_strerror_printf("Cannot open socket: %s", fr_syserror(errno));
+		return fd;
+	}
+
+	memset(link_layer, 0, sizeof(struct sockaddr_ll));
+
+	link_layer->sll_family = AF_PACKET;
+	link_layer->sll_protocol = 0;
+	link_layer->sll_ifindex = if_index;
+	link_layer->sll_hatype = ARPHRD_ETHER;
+	link_layer->sll_halen = ETH_ADDR_LEN;
+
+	if (bind(fd, (struct sockaddr *)link_layer, sizeof(struct sockaddr_ll)) < 0) {
+		close(fd);
+		fr_strerror_printf("Cannot bind raw socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return fd;
+}
+
+/** Get the Ethernet address of an interface
+ *
+ * @param[out] out		Where to write the address.
+ * @param[in] sockfd		Any socket, used for the ioctl.
+ * @param[in] interface		to get the address of.
  * @return
  *	- 0 on success.
  *	- -1 on failure.
  */
-int fr_dhcpv4_raw_packet_send(int sockfd, struct sockaddr_ll *link_layer, RADIUS_PACKET *packet)
+int fr_dhcpv4_raw_if_ethernet(uint8_t out[ETH_ADDR_LEN], int sockfd, char const *interface)
 {
-	uint8_t			dhcp_packet[1518] = { 0 };
-	ethernet_header_t	*eth_hdr = (ethernet_header_t *)dhcp_packet;
-	ip_header_t		*ip_hdr = (ip_header_t *)(dhcp_packet + ETH_HDR_SIZE);
-	udp_header_t		*udp_hdr = (udp_header_t *) (dhcp_packet + ETH_HDR_SIZE + IP_HDR_SIZE);
-	dhcp_packet_t		*dhcp = (dhcp_packet_t *)(dhcp_packet + ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE);
+	struct ifreq ifr;
 
-	uint16_t		l4_len = (UDP_HDR_SIZE + packet->data_len);
-	VALUE_PAIR		*vp;
+	memset(&ifr, 0, sizeof(ifr));
+	strlcpy(ifr.ifr_name, interface, sizeof(ifr.ifr_name));
 
-	/* set ethernet source address to our MAC address (DHCP-Client-Hardware-Address). */
-	uint8_t dhmac[ETH_ADDR_LEN] = { 0 };
-	if ((vp = fr_pair_find_by_num(packet->vps, 267, DHCP_MAGIC_VENDOR, TAG_ANY))) {
-		if (vp->vp_type == FR_TYPE_ETHERNET) memcpy(dhmac, vp->vp_ether, sizeof(vp->vp_ether));
+	if (ioctl(sockfd, SIOCGIFHWADDR, &ifr) < 0) {
+		fr_strerror_printf("Failed getting Ethernet address of %s: %s", interface, fr_syserror(errno));
+		return -1;
+	}
+
+	if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+		fr_strerror_printf("Interface %s is not an Ethernet interface", interface);
+		return -1;
+	}
+
+	memcpy(out, ifr.ifr_hwaddr.sa_data, ETH_ADDR_LEN);
+
+	return 0;
+}
+
+/** Create the L2/L3/L4 headers for a DHCPv4 packet
+ *
+ * @param[out] out		Where to write the frame.
+ * @param[in] outlen		Length of the output buffer.
+ * @param[in] src_mac		Ethernet source address.
+ * @param[in] dst_mac		Ethernet destination address.
+ * @param[in] src_ipaddr	IPv4 source address.
+ * @param[in] src_port		UDP source port.
+ * @param[in] dst_ipaddr	IPv4 destination address.
+ * @param[in] dst_port		UDP destination port.
+ * @param[in] data		the encoded DHCPv4 packet.
+ * @param[in] data_len		Length of the encoded DHCPv4 packet.
+ * @return
+ *	- The length of the frame.
+ *	- -1 if the output buffer is too small.
+ */
+ssize_t fr_dhcpv4_raw_frame_build(uint8_t *out, size_t outlen,
+				  uint8_t const src_mac[ETH_ADDR_LEN], uint8_t const dst_mac[ETH_ADDR_LEN],
+				  fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
+				  fr_ipaddr_t const *dst_ipaddr, uint16_t dst_port,
+				  uint8_t const *data, size_t data_len)
+{
+	ethernet_header_t	*eth_hdr = (ethernet_header_t *)out;
+	ip_header_t		*ip_hdr = (ip_header_t *)(out + ETH_HDR_SIZE);
+	udp_header_t		*udp_hdr = (udp_header_t *) (out + ETH_HDR_SIZE + IP_HDR_SIZE);
+	uint16_t		l4_len = (UDP_HDR_SIZE + data_len);
+
+	if ((ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE + data_len) > outlen) {
+		fr_strerror_printf("Insufficient buffer space for frame");
+		return -1;
 	}
 
+	memset(out, 0, ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE);
+
 	/* fill in Ethernet layer (L2) */
-	memcpy(eth_hdr->ether_dst, eth_bcast, ETH_ADDR_LEN);
-	memcpy(eth_hdr->ether_src, dhmac, ETH_ADDR_LEN);
+	memcpy(eth_hdr->ether_dst, dst_mac, ETH_ADDR_LEN);
+	memcpy(eth_hdr->ether_src, src_mac, ETH_ADDR_LEN);
 	eth_hdr->ether_type = htons(ETH_TYPE_IP);
 
 	/* fill in IP layer (L3) */
 	ip_hdr->ip_vhl = IP_VHL(4, 5);
 	ip_hdr->ip_tos = 0;
-	ip_hdr->ip_len = htons(IP_HDR_SIZE +  UDP_HDR_SIZE + packet->data_len);
+	ip_hdr->ip_len = htons(IP_HDR_SIZE +  UDP_HDR_SIZE + data_len);
 	ip_hdr->ip_id = 0;
 	ip_hdr->ip_off = 0;
 	ip_hdr->ip_ttl = 64;
 	ip_hdr->ip_p = 17;
 	ip_hdr->ip_sum = 0; /* Filled later */
 
-	/* saddr: Packet-Src-IP-Address (default: 0.0.0.0). */
-	ip_hdr->ip_src.s_addr = packet->src_ipaddr.addr.v4.s_addr;
-
-	/* daddr: packet destination IP addr (should be 255.255.255.255 for broadcast). */
-	ip_hdr->ip_dst.s_addr = packet->dst_ipaddr.addr.v4.s_addr;
+	ip_hdr->ip_src.s_addr = src_ipaddr->addr.v4.s_addr;
+	ip_hdr->ip_dst.s_addr = dst_ipaddr->addr.v4.s_addr;
 
 	/* IP header checksum */
 	ip_hdr->ip_sum = fr_ip_header_checksum((uint8_t const *)ip_hdr, 5);
 
-	udp_hdr->src = htons(packet->src_port);
-	udp_hdr->dst = htons(packet->dst_port);
+	udp_hdr->src = htons(src_port);
+	udp_hdr->dst = htons(dst_port);
 
 	udp_hdr->len = htons(l4_len);
 	udp_hdr->checksum = 0; /* UDP checksum will be done after dhcp header */
 
 	/* DHCP layer (L7) */
-
-	/* just copy what FreeRADIUS has encoded for us. */
-	memcpy(dhcp, packet->data, packet->data_len);
+	memcpy(out + ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE, data, data_len);
 
 	/* UDP checksum is done here */
-	udp_hdr->checksum = fr_udp_checksum((uint8_t const *)(dhcp_packet + ETH_HDR_SIZE + IP_HDR_SIZE),
-					    ntohs(udp_hdr->len), udp_hdr->checksum,
-					    packet->src_ipaddr.addr.v4, packet->dst_ipaddr.addr.v4);
+	udp_hdr->checksum = fr_udp_checksum((uint8_t const *)udp_hdr, l4_len, udp_hdr->checksum,
+					    src_ipaddr->addr.v4, dst_ipaddr->addr.v4);
 
-	return sendto(sockfd, dhcp_packet, (ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE + packet->data_len),
+	return ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE + data_len;
+}
+
+/** Create the requisite L2/L3 headers, and write a DHCPv4 packet to a raw socket
+ *
+ * @param[in] sockfd		to write to.
+ * @param[in] link_layer	information, as returned by fr_dhcpv4_raw_socket_open.
+ * @param[in] packet		to write.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_dhcpv4_raw_packet_send(int sockfd, struct sockaddr_ll *link_layer, RADIUS_PACKET *packet)
+{
+	uint8_t			dhcp_packet[1518] = { 0 };
+	ssize_t			frame_len;
+	VALUE_PAIR		*vp;
+
+	/* set ethernet source address to our MAC address (DHCP-Client-Hardware-Address). */
+	uint8_t dhmac[ETH_ADDR_LEN] = { 0 };
+	if ((vp = fr_pair_find_by_num(packet->vps, 267, DHCP_MAGIC_VENDOR, TAG_ANY))) {
+		if (vp->vp_type == FR_TYPE_ETHERNET) memcpy(dhmac, vp->vp_ether, sizeof(vp->vp_ether));
+	}
+
+	/*
+	 *	saddr: Packet-Src-IP-Address (default: 0.0.0.0).
+	 *	daddr: packet destination IP addr (should be 255.255.255.255 for broadcast).
+	 */
+	frame_len = fr_dhcpv4_raw_frame_build(dhcp_packet, sizeof(dhcp_packet), dhmac, eth_bcast,
+					      &packet->src_ipaddr, packet->src_port,
+					      &packet->dst_ipaddr, packet->dst_port,
+					      packet->data, packet->data_len);
+	if (frame_len < 0) return -1;
+
+	return sendto(sockfd, dhcp_packet, frame_len,
 		      0, (struct sockaddr *) link_layer, sizeof(struct sockaddr_ll));
 }
 
+/*
+ *	Frames in the TX ring hold one Ethernet frame each.  Blocks
+ *	have to be a multiple of the page size.
+ */
+#define RAW_RING_FRAME_SIZE	(2048)
+#define RAW_RING_BLOCK_FRAMES	(16)
+
+struct fr_dhcpv4_raw_ring_s {
+	int			sockfd;			//!< Raw socket the ring belongs to.
+
+	uint8_t			*map;			//!< The ring, shared with the kernel.
+	size_t			map_len;		//!< Length of the ring.
+
+	unsigned int		frame_nr;		//!< Number of frames in the ring.
+	unsigned int		next;			//!< Next frame to fill.
+	unsigned int		pending;		//!< Frames filled since the last flush.
+};
+
+static int _raw_ring_free(fr_dhcpv4_raw_ring_t *ring)
+{
+	if (ring->map) munmap(ring->map, ring->map_len);
+
+	return 0;
+}
+
+/** Set up a PACKET_MMAP TX ring on a raw socket
+ *
+ *  Frames are written into memory shared with the kernel, and a
+ *  batch of them is sent with one system call.
+ *
+ * @param[in] ctx	to allocate the ring in.
+ * @param[in] sockfd	as returned by #fr_dhcpv4_raw_tx_socket_open.
+ * @param[in] frames	minimum number of frames in the ring.
+ * @return
+ *	- The ring.
+ *	- NULL on error.
+ */
+fr_dhcpv4_raw_ring_t *fr_dhcpv4_raw_ring_alloc(TALLOC_CTX *ctx, int sockfd, unsigned int frames)
+{
+	fr_dhcpv4_raw_ring_t	*ring;
+	struct tpacket_req	req;
+	int			version = TPACKET_V2;
+
+	ring = talloc_zero(ctx, fr_dhcpv4_raw_ring_t);
+	if (!ring) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	ring->sockfd = sockfd;
+
+	if (setsockopt(sockfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		fr_strerror_printf("Failed setting TPACKET_V2: %s", fr_syserror(errno));
+	error:
+		talloc_free(ring);
+		return NULL;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_frame_size = RAW_RING_FRAME_SIZE;
+	req.tp_block_size = RAW_RING_FRAME_SIZE * RAW_RING_BLOCK_FRAMES;
+	req.tp_block_nr = (frames + RAW_RING_BLOCK_FRAMES - 1) / RAW_RING_BLOCK_FRAMES;
+	req.tp_frame_nr = req.tp_block_nr * RAW_RING_BLOCK_FRAMES;
+
+	if (setsockopt(sockfd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+		fr_strerror_printf("Failed creating TX ring: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	ring->map_len = (size_t) req.tp_block_size * req.tp_block_nr;
+	ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, sockfd, 0);
+	if (ring->map == MAP_FAILED) {
+		ring->map = NULL;
+		fr_strerror_printf("Failed mapping TX ring: %s", fr_syserror(errno));
+		goto error;
+	}
+	ring->frame_nr = req.tp_frame_nr;
+
+	talloc_set_destructor(ring, _raw_ring_free);
+
+	return ring;
+}
+
+/** Add a DHCPv4 packet to the TX ring
+ *
+ *  The packet isn't sent until #fr_dhcpv4_raw_ring_flush is called.
+ *
+ * @param[in] ring		to add the packet to.
+ * @param[in] src_mac		Ethernet source address.
+ * @param[in] dst_mac		Ethernet destination address.
+ * @param[in] src_ipaddr	IPv4 source address.
+ * @param[in] src_port		UDP source port.
+ * @param[in] dst_ipaddr	IPv4 destination address.
+ * @param[in] dst_port		UDP destination port.
+ * @param[in] data		the encoded DHCPv4 packet.
+ * @param[in] data_len		Length of the encoded DHCPv4 packet.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the ring is full, or the packet is too large.
+ */
+int fr_dhcpv4_raw_ring_queue(fr_dhcpv4_raw_ring_t *ring,
+			     uint8_t const src_mac[ETH_ADDR_LEN], uint8_t const dst_mac[ETH_ADDR_LEN],
+			     fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
+			     fr_ipaddr_t const *dst_ipaddr, uint16_t dst_port,
+			     uint8_t const *data, size_t data_len)
+{
+	struct tpacket2_hdr	*hdr;
+	size_t			offset = TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+	ssize_t			frame_len;
+
+	hdr = (struct tpacket2_hdr *) (ring->map + ((size_t) ring->next * RAW_RING_FRAME_SIZE));
+
+	/*
+	 *	The kernel hasn't sent this frame yet.  Push out
+	 *	what we have, and let the caller try again later.
+	 */
+	if ((hdr->tp_status != TP_STATUS_AVAILABLE) && (hdr->tp_status != TP_STATUS_WRONG_FORMAT)) {
+		(void) fr_dhcpv4_raw_ring_flush(ring);
+		fr_strerror_printf("TX ring is full");
+		return -1;
+	}
+
+	frame_len = fr_dhcpv4_raw_frame_build(((uint8_t *) hdr) + offset, RAW_RING_FRAME_SIZE - offset,
+					      src_mac, dst_mac, src_ipaddr, src_port, dst_ipaddr, dst_port,
+					      data, data_len);
+	if (frame_len < 0) return -1;
+
+	hdr->tp_len = frame_len;
+
+	/*
+	 *	The frame has to be written before the kernel
+	 *	sees the status change.
+	 */
+	__sync_synchronize();
+	hdr->tp_status = TP_STATUS_SEND_REQUEST;
+
+	ring->next = (ring->next + 1) % ring->frame_nr;
+	ring->pending++;
+
+	return 0;
+}
+
+/** Tell the kernel to send the frames in the TX ring
+ *
+ * @param[in] ring	to send.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_dhcpv4_raw_ring_flush(fr_dhcpv4_raw_ring_t *ring)
+{
+	if (!ring->pending) return 0;
+
+	ring->pending = 0;
+
+	if ((send(ring->sockfd, NULL, 0, MSG_DONTWAIT) < 0) && (errno != EAGAIN) && (errno != ENOBUFS)) {
+		fr_strerror_printf("Failed sending TX ring: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  *	For a client, receive a DHCP packet from a raw packet
  *	socket. Make sure it matches the ongoing request.
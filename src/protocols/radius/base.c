@@ -298,12 +298,13 @@ invalid:
  * @param original the raw original request (if this is a response)
  * @param secret the shared secret
  * @param secret_len the length of the secret
+ * @param hmac_key precomputed HMAC-MD5 state for the secret, or NULL
  * @return
  *	- <0 on error
  *	- 0 on success
  */
 int fr_radius_sign(uint8_t *packet, uint8_t const *original,
-		   uint8_t const *secret, size_t secret_len)
+		   uint8_t const *secret, size_t secret_len, fr_hmac_md5_key_t const *hmac_key)
 {
 	uint8_t *msg, *end;
 	size_t packet_len = (packet[2] << 8) | packet[3];
@@ -384,7 +385,11 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 		 *	Message-Authenticator attribute.
 		 */
 		memset(msg + 2, 0, AUTH_VECTOR_LEN);
-		fr_hmac_md5(msg + 2, packet, packet_len, secret, secret_len);
+		if (hmac_key) {
+			fr_hmac_md5_precomputed(msg + 2, packet, packet_len, hmac_key);
+		} else {
+			fr_hmac_md5(msg + 2, packet, packet_len, secret, secret_len);
+		}
 		break;
 	}
 
@@ -704,41 +709,22 @@ finish:
 }
 
 
-/** Verify a request / response packet
- *
- *  This function does its work by calling fr_radius_sign(), and then
- *  comparing the signature in the packet with the one we calculated.
- *  If they differ, there's a problem.
+/** Find the Message-Authenticator in a packet
  *
- * @param packet the raw RADIUS packet (request or response)
- * @param original the raw original request (if this is a response)
- * @param secret the shared secret
- * @param secret_len the length of the secret
+ * @param[out] out		the Message-Authenticator attribute, or NULL if the
+ *				packet doesn't contain one.
+ * @param[in] packet		the raw RADIUS packet.
+ * @param[in] packet_len	the length of the packet.
  * @return
  *	- <0 on error
  *	- 0 on success
  */
-int fr_radius_verify(uint8_t *packet, uint8_t const *original,
-		     uint8_t const *secret, size_t secret_len)
+static int radius_message_authenticator(uint8_t **out, uint8_t *packet, size_t packet_len)
 {
-	int rcode;
 	uint8_t *msg, *end;
-	size_t packet_len = (packet[2] << 8) | packet[3];
-	uint8_t request_authenticator[AUTH_VECTOR_LEN];
-	uint8_t message_authenticator[AUTH_VECTOR_LEN];
-
-	if (packet_len < RADIUS_HDR_LEN) {
-		fr_strerror_printf("invalid packet length %zd", packet_len);
-		return -1;
-	}
 
-	memcpy(request_authenticator, packet + 4, sizeof(request_authenticator));
+	*out = NULL;
 
-	/*
-	 *	Find Message-Authenticator.  Its value has to be
-	 *	calculated before we calculate the Request
-	 *	Authenticator or the Response Authenticator.
-	 */
 	msg = packet + RADIUS_HDR_LEN;
 	end = packet + packet_len;
 
@@ -762,20 +748,63 @@ int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 			return -1;
 		}
 
-		/*
-		 *	Found it, save a copy.
-		 */
-		memcpy(message_authenticator, msg + 2, sizeof(message_authenticator));
+		*out = msg;
 		break;
 	}
 
+	return 0;
+}
+
+/** Verify a request / response packet
+ *
+ *  This function does its work by calling fr_radius_sign(), and then
+ *  comparing the signature in the packet with the one we calculated.
+ *  If they differ, there's a problem.
+ *
+ * @param packet the raw RADIUS packet (request or response)
+ * @param original the raw original request (if this is a response)
+ * @param secret the shared secret
+ * @param secret_len the length of the secret
+ * @param hmac_key precomputed HMAC-MD5 state for the secret, or NULL
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_radius_verify(uint8_t *packet, uint8_t const *original,
+		     uint8_t const *secret, size_t secret_len, fr_hmac_md5_key_t const *hmac_key)
+{
+	int rcode;
+	uint8_t *msg;
+	size_t packet_len = (packet[2] << 8) | packet[3];
+	uint8_t request_authenticator[AUTH_VECTOR_LEN];
+	uint8_t message_authenticator[AUTH_VECTOR_LEN];
+
+	if (packet_len < RADIUS_HDR_LEN) {
+		fr_strerror_printf("invalid packet length %zd", packet_len);
+		return -1;
+	}
+
+	memcpy(request_authenticator, packet + 4, sizeof(request_authenticator));
+
+	/*
+	 *	Find Message-Authenticator.  Its value has to be
+	 *	calculated before we calculate the Request
+	 *	Authenticator or the Response Authenticator.
+	 */
+	if (radius_message_authenticator(&msg, packet, packet_len) < 0) return -1;
+
+	/*
+	 *	Found it, save a copy.
+	 */
+	if (msg) memcpy(message_authenticator, msg + 2, sizeof(message_authenticator));
+
 	/*
 	 *	Implement verification as a signature, followed by
 	 *	checking our signature against the sent one.  This is
 	 *	slightly more CPU work than having verify-specific
 	 *	functions, but it ends up being cleaner in the code.
 	 */
-	rcode = fr_radius_sign(packet, original, secret, secret_len);
+	rcode = fr_radius_sign(packet, original, secret, secret_len, hmac_key);
 	if (rcode < 0) {
 		fr_strerror_printf("unknown packet code");
 		return -1;
@@ -788,7 +817,7 @@ int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 	 *	Message-Authenticator and Request Authenticator
 	 *	fields.
 	 */
-	if ((msg < end) &&
+	if (msg &&
 	    (fr_digest_cmp(message_authenticator, msg + 2, sizeof(message_authenticator)) != 0)) {
 		memcpy(msg + 2, message_authenticator, sizeof(message_authenticator));
 		memcpy(packet + 4, request_authenticator, sizeof(request_authenticator));
@@ -815,11 +844,288 @@ int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 		} else {
 			fr_strerror_printf("invalid Request Authenticator (shared secret is incorrect)");
 		}
+		return -1;
 	}
 
 	return 0;
 }
 
+/*
+ *	The most packets fr_radius_verify_batch() hashes at once.
+ */
+#define RADIUS_VERIFY_CHUNK	(32)
+
+/** Set the Request Authenticator field to what the signature is calculated over
+ *
+ * @param[in] packet	to update.
+ * @param[in] original	request, if this is a response.
+ * @param[in] ma	whether we're calculating the Message-Authenticator,
+ *			or the Request / Response Authenticator.
+ * @return
+ *	- <0 if the packet can't be verified.
+ *	- 0 if there's nothing to calculate.
+ *	- 1 if the signature should be calculated.
+ */
+static int radius_verify_vector(uint8_t *packet, uint8_t const *original, bool ma)
+{
+	switch (packet[0]) {
+	case FR_CODE_ACCESS_REQUEST:
+	case FR_CODE_STATUS_SERVER:
+		return ma ? 1 : 0;
+
+	case FR_CODE_ACCOUNTING_REQUEST:
+	case FR_CODE_DISCONNECT_REQUEST:
+	case FR_CODE_COA_REQUEST:
+		if (!ma) {
+			memset(packet + 4, 0, AUTH_VECTOR_LEN);
+			return 1;
+		}
+		/* FALL-THROUGH */
+
+	case FR_CODE_DISCONNECT_ACK:
+	case FR_CODE_DISCONNECT_NAK:
+	case FR_CODE_COA_ACK:
+	case FR_CODE_COA_NAK:
+		if (!original) break;
+
+		if (ma) {
+			memset(packet + 4, 0, AUTH_VECTOR_LEN);
+		} else {
+			memcpy(packet + 4, original + 4, AUTH_VECTOR_LEN);
+		}
+		return 1;
+
+	case FR_CODE_ACCOUNTING_RESPONSE:
+		if (!original) break;
+
+		if (ma && (original[0] != FR_CODE_STATUS_SERVER)) {
+			memset(packet + 4, 0, AUTH_VECTOR_LEN);
+		} else {
+			memcpy(packet + 4, original + 4, AUTH_VECTOR_LEN);
+		}
+		return 1;
+
+	case FR_CODE_ACCESS_ACCEPT:
+	case FR_CODE_ACCESS_REJECT:
+	case FR_CODE_ACCESS_CHALLENGE:
+		if (!original) break;
+
+		memcpy(packet + 4, original + 4, AUTH_VECTOR_LEN);
+		return 1;
+
+	default:
+		break;
+	}
+
+	fr_strerror_printf("unknown packet code");
+	return -1;
+}
+
+/** Verify up to RADIUS_VERIFY_CHUNK packets
+ *
+ */
+static int radius_verify_chunk(fr_radius_batch_t *batch, int num)
+{
+	int		i, hashed, failed = 0;
+	uint8_t		*ma[RADIUS_VERIFY_CHUNK];
+	uint8_t		ma_sent[RADIUS_VERIFY_CHUNK][AUTH_VECTOR_LEN];
+	uint8_t		vector_sent[RADIUS_VERIFY_CHUNK][AUTH_VECTOR_LEN];
+	uint8_t		calc[RADIUS_VERIFY_CHUNK][MD5_DIGEST_LENGTH];
+	uint8_t		ipad[RADIUS_VERIFY_CHUNK][MD5_BLOCK_LENGTH];
+	uint8_t		opad[RADIUS_VERIFY_CHUNK][MD5_BLOCK_LENGTH];
+	int		idx[RADIUS_VERIFY_CHUNK];
+	fr_md5_multi_t	msg[RADIUS_VERIFY_CHUNK];
+
+	/*
+	 *	Find the Message-Authenticators, and set up the inner
+	 *	HMAC-MD5 hash for each packet which has one.
+	 */
+	for (i = 0, hashed = 0; i < num; i++) {
+		fr_radius_batch_t	*b = &batch[i];
+		size_t			packet_len = (b->packet[2] << 8) | b->packet[3];
+		uint8_t const		*key = b->secret;
+		size_t			key_len = b->secret_len;
+		uint8_t			key_digest[MD5_DIGEST_LENGTH];
+		size_t			j;
+
+		ma[i] = NULL;
+		b->rcode = 0;
+
+		if (packet_len < RADIUS_HDR_LEN) {
+			fr_strerror_printf("invalid packet length %zd", packet_len);
+			b->rcode = -1;
+			continue;
+		}
+
+		memcpy(vector_sent[i], b->packet + 4, AUTH_VECTOR_LEN);
+
+		if (radius_message_authenticator(&ma[i], b->packet, packet_len) < 0) {
+			b->rcode = -1;
+			continue;
+		}
+		if (!ma[i]) continue;
+
+		if (radius_verify_vector(b->packet, b->original, true) < 0) {
+			b->rcode = -1;
+			ma[i] = NULL;
+			continue;
+		}
+
+		memcpy(ma_sent[i], ma[i] + 2, AUTH_VECTOR_LEN);
+		memset(ma[i] + 2, 0, AUTH_VECTOR_LEN);
+
+		msg[hashed].out = calc[i];
+		idx[hashed++] = i;
+
+		/*
+		 *	The pads have already been hashed.
+		 */
+		if (b->hmac_key) {
+			msg[hashed - 1].ctx = &b->hmac_key->inner;
+			msg[hashed - 1].in[0] = b->packet;
+			msg[hashed - 1].inlen[0] = packet_len;
+			msg[hashed - 1].in[1] = NULL;
+			msg[hashed - 1].inlen[1] = 0;
+			continue;
+		}
+
+		/*
+		 *	Keys longer than a block are hashed first, as
+		 *	with fr_hmac_md5().
+		 */
+		if (key_len > MD5_BLOCK_LENGTH) {
+			fr_md5_calc(key_digest, key, key_len);
+			key = key_digest;
+			key_len = sizeof(key_digest);
+		}
+
+		memset(ipad[i], 0, MD5_BLOCK_LENGTH);
+		memcpy(ipad[i], key, key_len);
+		memcpy(opad[i], ipad[i], MD5_BLOCK_LENGTH);
+		for (j = 0; j < MD5_BLOCK_LENGTH; j++) {
+			ipad[i][j] ^= 0x36;
+			opad[i][j] ^= 0x5c;
+		}
+
+		msg[hashed - 1].ctx = NULL;
+		msg[hashed - 1].in[0] = ipad[i];
+		msg[hashed - 1].inlen[0] = MD5_BLOCK_LENGTH;
+		msg[hashed - 1].in[1] = b->packet;
+		msg[hashed - 1].inlen[1] = packet_len;
+	}
+
+	if (hashed > 0) {
+		fr_md5_calc_multi(msg, hashed);
+
+		/*
+		 *	The outer hash, over the inner digest.
+		 */
+		for (i = 0; i < hashed; i++) {
+			fr_radius_batch_t *b = &batch[idx[i]];
+
+			if (b->hmac_key) {
+				msg[i].ctx = &b->hmac_key->outer;
+				msg[i].in[0] = calc[idx[i]];
+				msg[i].inlen[0] = MD5_DIGEST_LENGTH;
+				continue;
+			}
+
+			msg[i].in[0] = opad[idx[i]];
+			msg[i].in[1] = calc[idx[i]];
+			msg[i].inlen[1] = MD5_DIGEST_LENGTH;
+		}
+
+		fr_md5_calc_multi(msg, hashed);
+	}
+
+	/*
+	 *	Check the Message-Authenticators, and restore the
+	 *	fields we changed.  Then set up the Request /
+	 *	Response Authenticator hash for each packet which is
+	 *	still OK.
+	 */
+	for (i = 0, hashed = 0; i < num; i++) {
+		fr_radius_batch_t	*b = &batch[i];
+		int			rcode;
+
+		if (ma[i]) {
+			memcpy(ma[i] + 2, ma_sent[i], AUTH_VECTOR_LEN);
+			memcpy(b->packet + 4, vector_sent[i], AUTH_VECTOR_LEN);
+
+			if (fr_digest_cmp(ma_sent[i], calc[i], AUTH_VECTOR_LEN) != 0) {
+				fr_strerror_printf("invalid Message-Authenticator (shared secret is incorrect)");
+				b->rcode = -1;
+			}
+		}
+
+		if (b->rcode < 0) continue;
+
+		rcode = radius_verify_vector(b->packet, b->original, false);
+		if (rcode < 0) {
+			b->rcode = -1;
+			continue;
+		}
+		if (rcode == 0) continue;
+
+		msg[hashed].ctx = NULL;
+		msg[hashed].in[0] = b->packet;
+		msg[hashed].inlen[0] = (b->packet[2] << 8) | b->packet[3];
+		msg[hashed].in[1] = b->secret;
+		msg[hashed].inlen[1] = b->secret_len;
+		msg[hashed].out = calc[i];
+		idx[hashed++] = i;
+	}
+
+	if (hashed > 0) fr_md5_calc_multi(msg, hashed);
+
+	for (i = 0; i < hashed; i++) {
+		fr_radius_batch_t *b = &batch[idx[i]];
+
+		memcpy(b->packet + 4, vector_sent[idx[i]], AUTH_VECTOR_LEN);
+
+		if (fr_digest_cmp(vector_sent[idx[i]], calc[idx[i]], AUTH_VECTOR_LEN) != 0) {
+			if (b->original) {
+				fr_strerror_printf("invalid Response Authenticator (shared secret is incorrect)");
+			} else {
+				fr_strerror_printf("invalid Request Authenticator (shared secret is incorrect)");
+			}
+			b->rcode = -1;
+		}
+	}
+
+	for (i = 0; i < num; i++) if (batch[i].rcode < 0) failed++;
+
+	return failed;
+}
+
+/** Verify a batch of request / response packets
+ *
+ *  This gives the same results as calling fr_radius_verify() for each
+ *  packet, but the MD5 hashes for all of the packets are calculated
+ *  together with fr_md5_calc_multi().
+ *
+ *  As with fr_radius_verify(), the packets are left unchanged.
+ *
+ * @param[in,out] batch	of packets to verify.  The result for each packet
+ *			is written to its "rcode" field.
+ * @param[in] num	number of packets in the batch.
+ * @return the number of packets which failed verification.
+ */
+int fr_radius_verify_batch(fr_radius_batch_t *batch, int num)
+{
+	int i, failed = 0;
+
+	for (i = 0; i < num; i += RADIUS_VERIFY_CHUNK) {
+		int chunk = num - i;
+
+		if (chunk > RADIUS_VERIFY_CHUNK) chunk = RADIUS_VERIFY_CHUNK;
+
+		failed += radius_verify_chunk(batch + i, chunk);
+	}
+
+	return failed;
+}
+
 /** Encode VPS into a raw RADIUS packet.
  *
  */
@@ -514,13 +514,18 @@ static ssize_t fr_radius_decode_struct(TALLOC_CTX *ctx, vp_cursor_t *cursor,
 /** Convert a top-level VSA to a VP.
  *
  * "length" can be LONGER than just this sub-vsa.
+ *
+ * The vendor's type and length sizes are taken from the flags of the
+ * vendor attribute, which are set from the VENDOR format when the
+ * dictionary is loaded.  This avoids a vendor lookup per VSA.
  */
 static ssize_t decode_vsa_internal(TALLOC_CTX *ctx, vp_cursor_t *cursor,
 				   fr_dict_attr_t const *parent,
 				   uint8_t const *data, size_t data_len,
-				   void *decoder_ctx, fr_dict_vendor_t const *dv)
+				   void *decoder_ctx)
 {
 	unsigned int		attribute;
+	unsigned int		type_size, length;
 	ssize_t			attrlen, my_len;
 	fr_dict_attr_t const	*da;
 
@@ -532,16 +537,19 @@ static ssize_t decode_vsa_internal(TALLOC_CTX *ctx, vp_cursor_t *cursor,
 		return -1;
 	}
 
+	type_size = parent->flags.type_size;
+	length = parent->flags.length;
+
 	FR_PROTO_TRACE("Length %u", (unsigned int)data_len);
 
 #ifndef NDEBUG
-	if (data_len <= (dv->type + dv->length)) {
+	if (data_len <= (type_size + length)) {
 		fr_strerror_printf("%s: Failure to call fr_radius_decode_tlv_ok", __FUNCTION__);
 		return -1;
 	}
 #endif
 
-	switch (dv->type) {
+	switch (type_size) {
 	case 4:
 		/* data[0] must be zero */
 		attribute = data[1] << 16;
@@ -563,14 +571,14 @@ static ssize_t decode_vsa_internal(TALLOC_CTX *ctx, vp_cursor_t *cursor,
 		return -1;
 	}
 
-	switch (dv->length) {
+	switch (length) {
 	case 2:
-		/* data[dv->type] must be zero, from fr_radius_decode_tlv_ok() */
-		attrlen = data[dv->type + 1];
+		/* data[type_size] must be zero, from fr_radius_decode_tlv_ok() */
+		attrlen = data[type_size + 1];
 		break;
 
 	case 1:
-		attrlen = data[dv->type];
+		attrlen = data[type_size];
 		break;
 
 	case 0:
@@ -586,12 +594,12 @@ static ssize_t decode_vsa_internal(TALLOC_CTX *ctx, vp_cursor_t *cursor,
 	 *	See if the VSA is known.
 	 */
 	da = fr_dict_attr_child_by_num(parent, attribute);
-	if (!da) da = fr_dict_unknown_afrom_fields(ctx, parent, dv->vendorpec, attribute);
+	if (!da) da = fr_dict_unknown_afrom_fields(ctx, parent, parent->attr, attribute);
 	if (!da) return -1;
 	FR_PROTO_TRACE("decode context changed %s -> %s", da->parent->name, da->name);
 
-	my_len = fr_radius_decode_pair_value(ctx, cursor, da, data + dv->type + dv->length,
-					     attrlen - (dv->type + dv->length), attrlen - (dv->type + dv->length),
+	my_len = fr_radius_decode_pair_value(ctx, cursor, da, data + type_size + length,
+					     attrlen - (type_size + length), attrlen - (type_size + length),
 					     decoder_ctx);
 	if (my_len < 0) return my_len;
 
@@ -789,9 +797,7 @@ static ssize_t decode_vsa(TALLOC_CTX *ctx, vp_cursor_t *cursor, fr_dict_attr_t c
 	size_t			total;
 	ssize_t			rcode;
 	uint32_t		vendor;
-	fr_dict_vendor_t const	*dv;
 	VALUE_PAIR		*head = NULL;
-	fr_dict_vendor_t	my_dv;
 	fr_dict_attr_t const	*vendor_da;
 	vp_cursor_t		tlv_cursor;
 
@@ -831,40 +837,34 @@ static ssize_t decode_vsa(TALLOC_CTX *ctx, vp_cursor_t *cursor, fr_dict_attr_t c
 		if (fr_dict_unknown_vendor_afrom_num(ctx, &n, parent, vendor) < 0) return -1;
 		vendor_da = n;
 
-		/*
-		 *	Create an unknown DV too...
-		 */
-		memset(&my_dv, 0, sizeof(my_dv));
-
-		my_dv.vendorpec = vendor;
-		my_dv.type = 1;
-		my_dv.length = 1;
-
-		dv = &my_dv;
-
 		goto create_attrs;
-	} else {
-		/*
-		 *	We found an attribute representing the vendor
-		 *	so it *MUST* exist in the vendor tree.
-		 */
-		dv = fr_dict_vendor_by_num(NULL, vendor);
-		if (!fr_cond_assert(dv)) return -1;
 	}
 	FR_PROTO_TRACE("decode context %s -> %s", parent->name, vendor_da->name);
 
 	/*
 	 *	WiMAX craziness
+	 *
+	 *	Only WiMAX needs the vendor definition, all the
+	 *	other vendors have their format in the vendor
+	 *	attribute's flags.
 	 */
-	if ((vendor == VENDORPEC_WIMAX) && dv->flags) {
-		rcode = decode_wimax(ctx, cursor, vendor_da, data, attr_len, packet_len, decoder_ctx, vendor);
-		return rcode;
+	if (vendor == VENDORPEC_WIMAX) {
+		fr_dict_vendor_t const *dv;
+
+		dv = fr_dict_vendor_by_num(NULL, vendor);
+		if (!fr_cond_assert(dv)) return -1;
+
+		if (dv->flags) {
+			rcode = decode_wimax(ctx, cursor, vendor_da, data, attr_len, packet_len, decoder_ctx, vendor);
+			return rcode;
+		}
 	}
 
 	/*
 	 *	VSAs should normally be in TLV format.
 	 */
-	if (fr_radius_decode_tlv_ok(data + 4, attr_len - 4, dv->type, dv->length) < 0) {
+	if (fr_radius_decode_tlv_ok(data + 4, attr_len - 4,
+				    vendor_da->flags.type_size, vendor_da->flags.length) < 0) {
 		FR_PROTO_TRACE("TLVs not OK: %s", fr_strerror());
 		return -1;
 	}
@@ -886,7 +886,7 @@ create_attrs:
 		/*
 		 *	Vendor attributes can have subattributes (if you hadn't guessed)
 		 */
-		vsa_len = decode_vsa_internal(ctx, &tlv_cursor, vendor_da, data, attr_len, decoder_ctx, dv);
+		vsa_len = decode_vsa_internal(ctx, &tlv_cursor, vendor_da, data, attr_len, decoder_ctx);
 		if (vsa_len < 0) {
 			fr_strerror_printf("%s: Internal sanity check %d", __FUNCTION__, __LINE__);
 			fr_pair_list_free(&head);
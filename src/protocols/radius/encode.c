@@ -29,6 +29,15 @@ RCSID("$Id$")
 
 static unsigned int salt_offset = 0;
 
+/** A pre-encoded attribute, hung off VALUE_PAIR->encoded
+ *
+ */
+typedef struct {
+	VALUE_PAIR const	*vp;				//!< The pair the encoding was made from.
+	size_t			len;				//!< Length of the encoded data.
+	uint8_t			data[];				//!< Wire format of the attribute.
+} radius_encoded_t;
+
 static ssize_t encode_value(uint8_t *out, size_t outlen,
 			    fr_dict_attr_t const **tlv_stack, int depth,
 			    vp_cursor_t *cursor, void *encoder_ctx);
@@ -72,6 +81,29 @@ static inline VALUE_PAIR *next_encodable(vp_cursor_t *cursor)
 	return fr_pair_cursor_current(cursor);
 }
 
+/** Check whether a pair still has the value it was pre-encoded with
+ *
+ * Copies of a pre-encoded pair share its encoding, but may since have
+ * been edited, so we compare the copy against the original.
+ *
+ * @param[in] vp	to check.
+ * @return
+ *	- The pre-encoded attribute.
+ *	- NULL if there isn't one, or it is no longer valid for vp.
+ */
+static inline radius_encoded_t const *encoded_valid(VALUE_PAIR const *vp)
+{
+	radius_encoded_t const *enc = vp->encoded;
+
+	if (!enc) return NULL;
+
+	if ((vp->type != VT_DATA) || (vp->da != enc->vp->da) || (vp->tag != enc->vp->tag)) return NULL;
+
+	if (fr_value_box_cmp(&vp->data, &enc->vp->data) != 0) return NULL;
+
+	return enc;
+}
+
 /** Encode a CHAP password
  *
  * @bug FIXME: might not work with Ascend because
@@ -1530,6 +1562,22 @@ ssize_t fr_radius_encode_pair(uint8_t *out, size_t outlen, vp_cursor_t *cursor,
 		return -1;
 	}
 
+	/*
+	 *	Constant attributes (e.g. from the "users" file) may
+	 *	have been encoded already.  If this pair, or the one
+	 *	it was copied from, is unchanged, use that.
+	 */
+	if (vp->encoded) {
+		radius_encoded_t const *enc;
+
+		enc = encoded_valid(vp);
+		if (enc && (enc->len <= outlen)) {
+			memcpy(out, enc->data, enc->len);
+			next_encodable(cursor);
+			return enc->len;
+		}
+	}
+
 	/*
 	 *	We allow zero-length strings in "unlang", but skip
 	 *	them (except for CUI, thanks WiMAX!) on all other
@@ -1636,3 +1684,71 @@ ssize_t fr_radius_encode_pair(uint8_t *out, size_t outlen, vp_cursor_t *cursor,
 
 	return ret;
 }
+
+/** Pre-encode the constant attributes in a list
+ *
+ * Attributes which don't depend on the packet they're sent in, or on
+ * the attributes around them, are encoded once, and the result stored
+ * in the pair.  fr_radius_encode_pair() then copies the data directly
+ * into the packet for the pair, or for any copy of it which hasn't been
+ * edited.
+ *
+ * Attributes which are encrypted, or which are members of TLVs or
+ * structs, are left for the full encoder.
+ *
+ * @param[in] vps	to pre-encode.  The list must not be modified
+ *			afterwards, and must outlive any copies made of it.
+ * @return the number of attributes pre-encoded.
+ */
+int fr_radius_encode_pair_cache(VALUE_PAIR *vps)
+{
+	VALUE_PAIR		*vp, *next;
+	vp_cursor_t		cursor;
+	radius_encoded_t	*enc;
+	ssize_t			len;
+	int			count = 0;
+	uint8_t			buffer[MAX_PACKET_LEN];
+
+	for (vp = vps; vp; vp = next) {
+		fr_dict_attr_t const *da = vp->da;
+
+		next = vp->next;
+
+		if (vp->encoded || (vp->type != VT_DATA)) continue;
+
+		if (da->flags.internal || da->flags.encrypt || da->flags.is_unknown) continue;
+
+		if ((da->vendor == 0) && ((da->attr >= 256) || (da->attr == FR_MESSAGE_AUTHENTICATOR))) continue;
+
+		if ((da->type == FR_TYPE_TLV) || (da->type == FR_TYPE_STRUCT)) continue;
+
+		if (!da->parent->flags.is_root &&
+		    ((da->parent->type == FR_TYPE_TLV) || (da->parent->type == FR_TYPE_STRUCT))) continue;
+
+		if (fr_radius_attr_len(vp) == 0) continue;
+
+		/*
+		 *	Encode the pair on its own, so that the
+		 *	result doesn't depend on its neighbours.
+		 */
+		vp->next = NULL;
+		fr_pair_cursor_init(&cursor, &vp);
+		len = fr_radius_encode_pair(buffer, sizeof(buffer), &cursor, NULL);
+		vp->next = next;
+
+		if ((len <= 0) || fr_pair_cursor_current(&cursor)) continue;
+
+		enc = talloc_size(vp, sizeof(*enc) + len);
+		if (!enc) return count;
+		talloc_set_name_const(enc, "radius_encoded_t");
+
+		enc->vp = vp;
+		enc->len = len;
+		memcpy(enc->data, buffer, len);
+
+		vp->encoded = enc;
+		count++;
+	}
+
+	return count;
+}
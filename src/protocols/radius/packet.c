@@ -101,13 +101,26 @@ int fr_radius_packet_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original
 }
 
 
-/** Calculate/check digest, and decode radius attributes
+/** Vendor-Specific attributes which haven't been decoded yet
  *
- * @return
- *	- 0 on success
- *	- -1 on decoding error.
  */
-int fr_radius_packet_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret)
+typedef struct {
+	uint32_t		vendor;			//!< From the Vendor-Id field.
+	uint16_t		offset;			//!< Of the attribute, from the start of the packet.
+	bool			decoded;		//!< Whether it's been added to packet->vps.
+} fr_radius_lazy_attr_t;
+
+struct fr_radius_lazy_s {
+	fr_radius_ctx_t		packet_ctx;		//!< Secret and vector to decode with.
+	int			num;			//!< Number of attributes.
+	int			pending;		//!< Number of attributes not yet decoded.
+	fr_radius_lazy_attr_t	attr[];			//!< Offset index over the packet.
+};
+
+/** Decode the packet, optionally leaving VSAs for later
+ *
+ */
+static int radius_packet_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret, bool lazy)
 {
 	int			packet_length;
 	uint32_t		num_attributes;
@@ -179,24 +192,59 @@ int fr_radius_packet_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char
 		ssize_t my_len;
 
 		/*
-		 *	This may return many VPs
+		 *	Note where the VSAs are, and skip them.  They're
+		 *	decoded by fr_radius_packet_decode_pending()
+		 *	when something asks for them.
 		 */
-		my_len = fr_radius_decode_pair(packet, &cursor, fr_dict_root(fr_dict_internal),
-					       ptr, packet_length, &packet_ctx);
-		if (my_len < 0) {
-			fr_pair_list_free(&head);
-			return -1;
-		}
+		if (lazy && (packet_length >= 7) && (ptr[0] == FR_VENDOR_SPECIFIC) &&
+		    (ptr[1] >= 7) && (ptr[1] <= packet_length) && (ptr[2] == 0)) {
+			fr_radius_lazy_attr_t *attr;
+
+			if (!packet->lazy) {
+				int max = (packet_length / 7) + 1;
+
+				packet->lazy = talloc_zero_size(packet, sizeof(fr_radius_lazy_t) +
+								(max * sizeof(fr_radius_lazy_attr_t)));
+				if (!packet->lazy) {
+					fr_pair_list_free(&head);
+					fr_strerror_printf("Out of memory");
+					return -1;
+				}
+				talloc_set_name_const(packet->lazy, "fr_radius_lazy_t");
+				packet->lazy->packet_ctx = packet_ctx;
+				packet->lazy->packet_ctx.vector = packet->vector;
+			}
 
-		/*
-		 *	This should really be an assertion.
-		 */
-		if (my_len == 0) break;
+			attr = &packet->lazy->attr[packet->lazy->num++];
+			attr->vendor = (ptr[3] << 16) | (ptr[4] << 8) | ptr[5];
+			attr->offset = ptr - packet->data;
+			packet->lazy->pending++;
+
+			my_len = ptr[1];
+			num_attributes++;
+
+		} else {
+			/*
+			 *	This may return many VPs
+			 */
+			my_len = fr_radius_decode_pair(packet, &cursor, fr_dict_root(fr_dict_internal),
+						       ptr, packet_length, &packet_ctx);
+			if (my_len < 0) {
+				fr_pair_list_free(&head);
+				TALLOC_FREE(packet->lazy);
+				return -1;
+			}
 
-		/*
-		 *	Count the ones which were just added
-		 */
-		while (fr_pair_cursor_next(&cursor)) num_attributes++;
+			/*
+			 *	This should really be an assertion.
+			 */
+			if (my_len == 0) break;
+
+			/*
+			 *	Count the ones which were just added
+			 */
+			while (fr_pair_cursor_next(&cursor)) num_attributes++;
+		}
 
 		/*
 		 *	VSA's may not have been counted properly in
@@ -208,6 +256,7 @@ int fr_radius_packet_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char
 			char host_ipaddr[INET6_ADDRSTRLEN];
 
 			fr_pair_list_free(&head);
+			TALLOC_FREE(packet->lazy);
 			fr_strerror_printf("Possible DoS attack from host %s: Too many attributes in request "
 					   "(received %d, max %d are allowed)",
 					   inet_ntop(packet->src_ipaddr.af,
@@ -234,6 +283,94 @@ int fr_radius_packet_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char
 	return 0;
 }
 
+/** Calculate/check digest, and decode radius attributes
+ *
+ * @return
+ *	- 0 on success
+ *	- -1 on decoding error.
+ */
+int fr_radius_packet_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret)
+{
+	return radius_packet_decode(packet, original, secret, false);
+}
+
+/** Decode a request, leaving Vendor-Specific attributes until they're needed
+ *
+ * Pass-through traffic (accounting in particular) often carries many VSAs
+ * which policy never looks at.  Instead of decoding them all into VALUE_PAIRs,
+ * we build an index of where they are in packet->data.  The VSAs for a vendor
+ * are then decoded with fr_radius_packet_decode_pending() when something
+ * asks for that vendor's attributes.
+ *
+ * packet->data must remain valid until all of the VSAs have been decoded, or
+ * the packet is freed.
+ *
+ * @param[in] packet	to decode.  Must be a request.
+ * @param[in] secret	the shared secret.  Must be talloc'd, and outlive the packet.
+ * @return
+ *	- 0 on success
+ *	- -1 on decoding error.
+ */
+int fr_radius_packet_decode_lazy(RADIUS_PACKET *packet, char const *secret)
+{
+	return radius_packet_decode(packet, NULL, secret, true);
+}
+
+/** Decode VSAs which fr_radius_packet_decode_lazy() skipped
+ *
+ * The new VALUE_PAIRs are added to the end of packet->vps.
+ *
+ * @param[in] packet	to decode more attributes from.
+ * @param[in] da	whose vendor's VSAs should be decoded.  If NULL, or a
+ *			VSA / vendor attribute, all pending VSAs are decoded.
+ * @return
+ *	- 0 on success (including if there was nothing to decode).
+ *	- -1 on decoding error.  The VSA which failed is discarded.
+ */
+int fr_radius_packet_decode_pending(RADIUS_PACKET *packet, fr_dict_attr_t const *da)
+{
+	fr_radius_lazy_t	*lazy = packet->lazy;
+	VALUE_PAIR		*head = NULL;
+	vp_cursor_t		cursor, out;
+	int			i, rcode = 0;
+
+	if (!lazy) return 0;
+
+	/*
+	 *	Standard attributes were decoded up front.
+	 */
+	if (da && !da->vendor && (da->type != FR_TYPE_VSA) && (da->type != FR_TYPE_VENDOR)) return 0;
+
+	fr_pair_cursor_init(&cursor, &head);
+
+	for (i = 0; i < lazy->num; i++) {
+		fr_radius_lazy_attr_t	*attr = &lazy->attr[i];
+		uint8_t const		*ptr = packet->data + attr->offset;
+
+		if (attr->decoded) continue;
+		if (da && da->vendor && (attr->vendor != da->vendor)) continue;
+
+		attr->decoded = true;
+		lazy->pending--;
+
+		if (fr_radius_decode_pair(packet, &cursor, fr_dict_root(fr_dict_internal),
+					  ptr, packet->data_len - attr->offset, &lazy->packet_ctx) < 0) {
+			rcode = -1;
+			continue;
+		}
+
+		fr_pair_cursor_last(&cursor);
+	}
+
+	fr_pair_cursor_init(&out, &packet->vps);
+	fr_pair_cursor_last(&out);
+	fr_pair_cursor_merge(&out, head);
+
+	if (!lazy->pending) TALLOC_FREE(packet->lazy);
+
+	return rcode;
+}
+
 
 /** See if the data pointed to by PTR is a valid RADIUS packet.
  *
@@ -287,7 +424,7 @@ int fr_radius_packet_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char
 	}
 
 	if (fr_radius_verify(packet->data, original_data,
-			     (uint8_t const *) secret, talloc_array_length(secret) - 1) < 0) {
+			     (uint8_t const *) secret, talloc_array_length(secret) - 1, NULL) < 0) {
 		fr_strerror_printf("Received packet from %s with %s",
 				   inet_ntop(packet->src_ipaddr.af, &packet->src_ipaddr.addr,
 					     buffer, sizeof(buffer)),
@@ -325,7 +462,7 @@ int fr_radius_packet_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 	}
 
 	rcode = fr_radius_sign(packet->data, original_data,
-			       (uint8_t const *) secret, talloc_array_length(secret) - 1);
+			       (uint8_t const *) secret, talloc_array_length(secret) - 1, NULL);
 	if (rcode < 0) return rcode;
 
 	memcpy(packet->vector, packet->data + 4, AUTH_VECTOR_LEN);
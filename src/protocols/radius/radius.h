@@ -27,6 +27,7 @@
 #include <freeradius-devel/cursor.h>
 #include <freeradius-devel/packet.h>
 #include <freeradius-devel/fr_log.h>
+#include <freeradius-devel/md5.h>
 
 #define AUTH_VECTOR_LEN		16
 #define CHAP_VALUE_LENGTH       16
@@ -66,15 +67,31 @@ typedef enum {
 	DECODE_FAIL_MAX
 } decode_fail_t;
 
+/** A packet to be verified by fr_radius_verify_batch()
+ *
+ */
+typedef struct {
+	uint8_t			*packet;		//!< The raw RADIUS packet (request or response).
+	uint8_t const		*original;		//!< The raw original request, if this is a response.
+	uint8_t const		*secret;		//!< The shared secret.
+	size_t			secret_len;		//!< The length of the secret.
+	fr_hmac_md5_key_t const	*hmac_key;		//!< Precomputed HMAC-MD5 state for the secret,
+							///< or NULL.
+	int			rcode;			//!< 0 if the packet verified, <0 if it didn't.
+} fr_radius_batch_t;
+
 /*
  *	protocols/radius/base.c
  */
 size_t		fr_radius_attr_len(VALUE_PAIR const *vp);
 
 int		fr_radius_sign(uint8_t *packet, uint8_t const *original,
-			       uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,3));
+			       uint8_t const *secret, size_t secret_len,
+			       fr_hmac_md5_key_t const *hmac_key) CC_HINT(nonnull (1,3));
 int		fr_radius_verify(uint8_t *packet, uint8_t const *original,
-				 uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,3));
+				 uint8_t const *secret, size_t secret_len,
+				 fr_hmac_md5_key_t const *hmac_key) CC_HINT(nonnull (1,3));
+int		fr_radius_verify_batch(fr_radius_batch_t *batch, int num) CC_HINT(nonnull);
 bool		fr_radius_ok(uint8_t const *packet, size_t *packet_len_p, bool require_ma,
 			     decode_fail_t *reason) CC_HINT(nonnull (1,2));
 
@@ -99,6 +116,8 @@ int		fr_radius_packet_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *origina
 					char const *secret) CC_HINT(nonnull (1,3));
 int		fr_radius_packet_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original,
 					char const *secret) CC_HINT(nonnull (1,3));
+int		fr_radius_packet_decode_lazy(RADIUS_PACKET *packet, char const *secret) CC_HINT(nonnull);
+int		fr_radius_packet_decode_pending(RADIUS_PACKET *packet, fr_dict_attr_t const *da) CC_HINT(nonnull (1));
 
 bool		fr_radius_packet_ok(RADIUS_PACKET *packet, bool require_ma,
 				    decode_fail_t *reason) CC_HINT(nonnull (1));
@@ -131,6 +150,8 @@ int		fr_radius_encode_chap_password(uint8_t *output, RADIUS_PACKET *packet, int
 
 ssize_t		fr_radius_encode_pair(uint8_t *out, size_t outlen, vp_cursor_t *cursor, void *encoder_ctx);
 
+int		fr_radius_encode_pair_cache(VALUE_PAIR *vps);
+
 /*
  *	protocols/radius/decode.c
  */
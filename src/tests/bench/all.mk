@@ -0,0 +1,32 @@
+#
+#  Throughput benchmarks.
+#
+#  These aren't part of "make test".  They take a long time, and the
+#  results depend on the machine.  "make bench" runs them along with
+#  the micro-benchmarks in src/tests/util.  To run only these:
+#
+#	make bench.throughput
+#
+#  Options for the benchmark script can be passed in BENCH_ARGS, e.g.
+#
+#	make bench.throughput BENCH_ARGS="-s pap,acct -w 1,2,4"
+#
+#  See README.md for what is measured, and the format of the results.
+#
+BENCH_DIR	:= $(DIR)
+BENCH_OUTPUT	:= $(BUILD_DIR)/tests/bench
+
+.PHONY: $(BENCH_OUTPUT)
+$(BENCH_OUTPUT):
+	${Q}mkdir -p $@
+
+.PHONY: bench bench.throughput clean.tests.bench
+bench.throughput: $(TESTBINDIR)/radiusd $(TESTBINDIR)/radclient | $(BENCH_OUTPUT) build.raddb
+	${Q}echo BENCH $(BENCH_OUTPUT)/bench.json
+	${Q}FR_LIBRARY_PATH=$(BUILD_DIR)/lib/local/.libs/ BENCH_BIN="$(TESTBIN)" BENCH_WORK=$(abspath $(BENCH_OUTPUT)) \
+		sh $(BENCH_DIR)/bench.sh -o $(BENCH_OUTPUT)/bench.json $(BENCH_ARGS)
+
+bench: bench.throughput
+
+clean.tests.bench:
+	${Q}rm -rf $(BENCH_OUTPUT)
@@ -0,0 +1,456 @@
+#!/bin/sh
+#
+#  Throughput benchmarks for radiusd.
+#
+#  For each scenario, and each combination of network and worker
+#  threads, start radiusd, and find the highest rate it can sustain.
+#  radclient generates the load, over the loopback interface.
+#
+#  A rate is sustainable when no requests are lost or dropped, nearly
+#  all of them are answered, radclient managed to send at that rate,
+#  and the 99th percentile latency is below a limit.  The search
+#  doubles the rate until it fails, and then bisects.
+#
+#  The results are written as JSON, so that runs on different builds
+#  can be compared.  See README.md.
+#
+#  $Id$
+#
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+
+#
+#  "-b" can be a command, e.g. a libtool wrapper, so it isn't quoted
+#  when used.
+#
+BIN=${BENCH_BIN:-./build/bin/local}
+DICT=${BENCH_DICT:-./share}
+RADDB=${BENCH_RADDB:-$(pwd)/raddb}
+WORK=${BENCH_WORK:-}
+OUTPUT=
+
+SCENARIOS="pap acct proxy peap"
+NETWORKS="1 2"
+WORKERS="1 2 4 8"
+DURATION=10
+START_RATE=2000
+PRECISION=5
+MAX_P99=${BENCH_MAX_P99:-50}
+CLIENT_THREADS=${BENCH_CLIENT_THREADS:-2}
+HOME_WORKERS=${BENCH_HOME_WORKERS:-4}
+PEAP_MAX=${BENCH_PEAP_MAX:-64}
+PORT=${BENCH_PORT:-42812}
+SECRET=testing123
+
+usage() {
+	cat <<EOF 1>&2
+Usage: $0 [options]
+  -b <bin>        Where radiusd and radclient are (default $BIN).
+  -d <seconds>    How long to run each step (default $DURATION).
+  -n <list>       Numbers of network threads, e.g. 1,2 (default "$NETWORKS").
+  -o <file>       Write the JSON results to 'file' (default stdout).
+  -p <percent>    Stop searching when the rate is known to 'percent' (default $PRECISION).
+  -r <rate>       The first rate to try, in packets/s (default $START_RATE).
+  -s <list>       Scenarios, from "pap acct proxy peap" (default all).
+  -w <list>       Numbers of worker threads, e.g. 1,2,4 (default "$WORKERS").
+
+Environment:
+  BENCH_MAX_P99         Highest sustainable p99 latency, in ms (default $MAX_P99).
+  BENCH_CLIENT_THREADS  radclient threads (default $CLIENT_THREADS).
+  BENCH_HOME_WORKERS    Worker threads for the "proxy" home server (default $HOME_WORKERS).
+  BENCH_PEAP_MAX        Most concurrent eapol_test sessions (default $PEAP_MAX).
+  BENCH_EAPOL_TEST      Path to eapol_test, for the "peap" scenario.
+  BENCH_PORT            First UDP port to use (default $PORT).
+  BENCH_WORK            Directory for logs and pid files (default a temporary one).
+EOF
+	exit 1
+}
+
+list() {
+	echo "$1" | tr ',' ' '
+}
+
+while getopts "b:d:hn:o:p:r:s:w:" opt; do
+	case $opt in
+	b)	BIN=$OPTARG ;;
+	d)	DURATION=$OPTARG ;;
+	n)	NETWORKS=$(list "$OPTARG") ;;
+	o)	OUTPUT=$OPTARG ;;
+	p)	PRECISION=$OPTARG ;;
+	r)	START_RATE=$OPTARG ;;
+	s)	SCENARIOS=$(list "$OPTARG") ;;
+	w)	WORKERS=$(list "$OPTARG") ;;
+	*)	usage ;;
+	esac
+done
+
+if [ -z "$WORK" ]; then
+	WORK=$(mktemp -d -t radiusd-bench.XXXXXX) || exit 1
+	trap 'rm -rf "$WORK"' EXIT
+fi
+mkdir -p "$WORK" || exit 1
+
+BENCH_CONFDIR="$BENCH_DIR/config"
+BENCH_RADDB="$RADDB"
+BENCH_WORK="$WORK"
+BENCH_PORT="$PORT"
+BENCH_HOME_PORT=$((PORT + 1))
+BENCH_HOME_WORKERS="$HOME_WORKERS"
+export BENCH_CONFDIR BENCH_RADDB BENCH_WORK BENCH_PORT BENCH_HOME_PORT BENCH_HOME_WORKERS
+
+HZ=$(getconf CLK_TCK 2>/dev/null || echo 100)
+
+log() {
+	echo "$*" 1>&2
+}
+
+#
+#  Escape a string for JSON.  The strings we output don't need much.
+#
+json_str() {
+	printf '"%s"' "$(printf '%s' "$1" | tr -d '"\\' | tr '\t\n' '  ')"
+}
+
+#
+#  A number, or null if there isn't one.
+#
+json_num() {
+	if [ -n "$1" ]; then printf '%s' "$1"; else printf 'null'; fi
+}
+
+#
+#  Start a server, and wait for it to write its PID file.
+#
+server_start() {
+	rm -f "$WORK/$1.pid" "$WORK/$1.log"
+
+	$BIN/radiusd -fP -d "$BENCH_CONFDIR" -n "$1" -D "$DICT" -l "$WORK/$1.log" > /dev/null 2>&1 &
+
+	i=0
+	while [ ! -s "$WORK/$1.pid" ]; do
+		i=$((i + 1))
+		if [ $i -gt 300 ]; then
+			log "radiusd -n $1 failed to start.  Last entries in $WORK/$1.log:"
+			tail -n 20 "$WORK/$1.log" 1>&2
+			return 1
+		fi
+		sleep 0.1
+	done
+
+	cat "$WORK/$1.pid"
+}
+
+server_stop() {
+	[ -n "$1" ] || return 0
+
+	kill -TERM "$1" 2>/dev/null
+	i=0
+	while kill -0 "$1" 2>/dev/null; do
+		i=$((i + 1))
+		if [ $i -gt 100 ]; then
+			kill -KILL "$1" 2>/dev/null
+			break
+		fi
+		sleep 0.1
+	done
+}
+
+#
+#  User and system CPU time, in clock ticks.  The command name is in
+#  brackets, and may contain spaces, so skip it first.
+#
+cpu_ticks() {
+	[ -r "/proc/$1/stat" ] || return 0
+	sed 's/^.*) //' "/proc/$1/stat" | awk '{ print $12 + $13 }'
+}
+
+#
+#  Resident and peak resident set size, in kB.
+#
+memory() {
+	[ -r "/proc/$1/status" ] || return 0
+	awk '/^VmRSS:/ { rss = $2 } /^VmHWM:/ { hwm = $2 } END { print "rss=" rss " hwm=" hwm }' "/proc/$1/status"
+}
+
+#
+#  Turn the radclient load summary into shell variables.
+#
+summary() {
+	awk -F: '
+		/^\t(Elapsed|Sent|Received|Lost|Stalled|Dropped|Invalid|Unexpected) / {
+			name = tolower($1)
+			gsub(/[ \t]/, "", name)
+			split($2, v, " ")
+			print name "=" v[1]
+		}
+		/^\tp(50|90|99|99\.9) / {
+			name = $1
+			gsub(/[ \t]/, "", name)
+			sub(/\./, "_", name)
+			split($2, v, " ")
+			print name "=" v[1]
+		}' "$1"
+}
+
+#
+#  Run radclient at one rate, and decide whether the server kept up.
+#
+#  Sets the variables from summary(), plus "ok", "reason", "achieved",
+#  "cpu_us" and "rss" / "hwm".
+#
+step() {
+	elapsed=0 sent=0 received=0 lost=0 stalled=0 dropped=0 invalid=0 unexpected=0
+	p50= p90= p99= p99_9= cpu_us= rss= hwm=
+
+	rm -f "$WORK/detail"
+
+	before=$(cpu_ticks "$pid")
+	$BIN/radclient -D "$DICT" -f "$BENCH_DIR/$template" -L "$1" -l "$DURATION" -T "$CLIENT_THREADS" \
+		"127.0.0.1:$PORT" "$type" "$SECRET" > "$WORK/step.out" 2>&1
+	after=$(cpu_ticks "$pid")
+	eval "$(memory "$pid")"
+	eval "$(summary "$WORK/step.out")"
+
+	if [ -n "$before" ] && [ -n "$after" ] && [ "$received" -gt 0 ]; then
+		cpu_us=$(awk -v t="$((after - before))" -v hz="$HZ" -v n="$received" \
+			'BEGIN { printf "%.3f", t * 1000000 / hz / n }')
+	fi
+
+	eval "$(awk -v rate="$1" -v elapsed="$elapsed" -v s="$sent" -v r="$received" -v l="$lost" \
+		-v st="$stalled" -v d="$dropped" -v p99="$p99" -v max="$MAX_P99" 'BEGIN {
+		achieved = (elapsed > 0) ? r / elapsed : 0
+		reason = ""
+		if (s == 0) reason = "nothing sent"
+		else if ((l > 0) || (d > 0)) reason = "lost " l ", dropped " d
+		else if (r < s * 0.999) reason = "received " r " of " s
+		else if (st > 0) reason = "stalled " st
+		else if (s < rate * elapsed * 0.98) reason = "radclient sent " s " of " int(rate * elapsed)
+		else if ((p99 == "") || (p99 > max)) reason = "p99 " p99 " ms"
+		printf "achieved=%.0f reason=\"%s\" ok=%d\n", achieved, reason, (reason == "")
+	}')"
+
+	log "	$1/s: received $received of $sent, p99 ${p99:-?} ms${reason:+, $reason}"
+
+	printf '%s{ "rate": %s, "sent": %s, "received": %s, "p99_ms": %s, "ok": %s, "reason": %s }' \
+		"$steps_sep" "$1" "$sent" "$received" "$(json_num "$p99")" \
+		"$([ "$ok" = 1 ] && echo true || echo false)" "$(json_str "$reason")" >> "$WORK/steps.json"
+	steps_sep=", "
+
+	sleep 2
+}
+
+#
+#  Find the highest sustainable rate, and remember the measurements
+#  from that step.
+#
+search() {
+	good=0 bad=0 rate=$START_RATE n=0
+	best=
+	steps_sep=
+	: > "$WORK/steps.json"
+
+	while [ $n -lt 20 ]; do
+		n=$((n + 1))
+		step "$rate"
+
+		if [ "$ok" = 1 ]; then
+			good=$rate
+			best="\"max_rate\": $rate, \"achieved_rate\": $achieved, \"sent\": $sent, \"received\": $received,
+      \"latency_ms\": { \"p50\": $(json_num "$p50"), \"p90\": $(json_num "$p90"), \"p99\": $(json_num "$p99"), \"p99.9\": $(json_num "$p99_9") },
+      \"cpu_us_per_packet\": $(json_num "$cpu_us"), \"rss_kb\": $(json_num "$rss"), \"hwm_kb\": $(json_num "$hwm")"
+		else
+			bad=$rate
+		fi
+
+		if [ $bad -eq 0 ]; then
+			rate=$((rate * 2))
+			continue
+		fi
+
+		if [ $good -eq 0 ]; then
+			rate=$((rate / 2))
+			[ $rate -ge 100 ] || break
+			continue
+		fi
+
+		[ $(((bad - good) * 100)) -gt $((good * PRECISION)) ] || break
+		rate=$(((good + bad) / 2))
+	done
+}
+
+#
+#  EAP-PEAP takes many round trips, which radclient can't do.  So
+#  we run eapol_test sessions in parallel, double the number of
+#  sessions until the throughput stops increasing, and report
+#  sessions/s instead of packets/s.
+#
+peap_step() {
+	end=$(($(date +%s) + DURATION))
+	before=$(cpu_ticks "$pid")
+
+	loops= i=0
+	while [ $i -lt "$1" ]; do
+		(
+			while [ "$(date +%s)" -lt $end ]; do
+				start=$(date +%s%N)
+				if $EAPOL_TEST -c "$BENCH_DIR/peap.eapol" -a 127.0.0.1 -p "$PORT" -s "$SECRET" -t 5 > /dev/null 2>&1; then
+					echo "ok $((($(date +%s%N) - start) / 1000))"
+				else
+					echo "fail"
+				fi
+			done > "$WORK/peap.out.$i"
+		) &
+		loops="$loops $!"
+		i=$((i + 1))
+	done
+	wait $loops
+
+	after=$(cpu_ticks "$pid")
+	eval "$(memory "$pid")"
+
+	cat "$WORK"/peap.out.* | awk '$1 == "ok" { print $2 / 1000 }' | sort -n > "$WORK/peap.sorted"
+	failed=$(cat "$WORK"/peap.out.* | grep -c fail)
+	received=$(wc -l < "$WORK/peap.sorted" | tr -d ' ')
+	rm -f "$WORK"/peap.out.*
+
+	eval "$(awk -v n="$received" -v d="$DURATION" '
+		function pct(p) { i = int(n * p); if (i >= n) i = n - 1; return v[i] }
+		{ v[NR - 1] = $1 }
+		END {
+			if (n == 0) { print "achieved=0 p50= p90= p99= p99_9="; exit }
+			printf "achieved=%.1f p50=%.3f p90=%.3f p99=%.3f p99_9=%.3f\n",
+				n / d, pct(0.5), pct(0.9), pct(0.99), pct(0.999)
+		}' "$WORK/peap.sorted")"
+
+	cpu_us=
+	if [ -n "$before" ] && [ -n "$after" ] && [ "$received" -gt 0 ]; then
+		cpu_us=$(awk -v t="$((after - before))" -v hz="$HZ" -v n="$received" \
+			'BEGIN { printf "%.3f", t * 1000000 / hz / n }')
+	fi
+
+	log "	$1 sessions: $achieved/s, $failed failed, p99 ${p99:-?} ms"
+
+	printf '%s{ "sessions": %s, "rate": %s, "failed": %s, "p99_ms": %s }' \
+		"$steps_sep" "$1" "$achieved" "$failed" "$(json_num "$p99")" >> "$WORK/steps.json"
+	steps_sep=", "
+}
+
+peap_search() {
+	concurrency=1 good=0
+	best=
+	steps_sep=
+	: > "$WORK/steps.json"
+
+	while [ "$concurrency" -le "$PEAP_MAX" ]; do
+		peap_step "$concurrency"
+
+		[ "$failed" -eq 0 ] || break
+		awk -v a="$achieved" -v g="$good" -v p="$PRECISION" 'BEGIN { exit !(a > g * (1 + p / 100)) }' || break
+
+		good=$achieved
+		best="\"max_rate\": $achieved, \"concurrency\": $concurrency, \"received\": $received,
+      \"latency_ms\": { \"p50\": $(json_num "$p50"), \"p90\": $(json_num "$p90"), \"p99\": $(json_num "$p99"), \"p99.9\": $(json_num "$p99_9") },
+      \"cpu_us_per_session\": $(json_num "$cpu_us"), \"rss_kb\": $(json_num "$rss"), \"hwm_kb\": $(json_num "$hwm")"
+
+		concurrency=$((concurrency * 2))
+	done
+}
+
+#
+#  Run one scenario at one point in the sweep.
+#
+run() {
+	scenario=$1
+	BENCH_NETWORKS=$2
+	BENCH_WORKERS=$3
+	export BENCH_NETWORKS BENCH_WORKERS
+
+	log "$scenario: $BENCH_NETWORKS network thread(s), $BENCH_WORKERS worker thread(s)"
+
+	home=
+	unit="packets/s"
+	case $scenario in
+	pap)	template=pap.request type=auth ;;
+	acct)	template=acct.request type=acct ;;
+	proxy)	template=pap.request type=auth
+		home=$(server_start home) || return 1
+		;;
+	peap)	unit="sessions/s" ;;
+	esac
+
+	pid=$(server_start "$scenario")
+	if [ -z "$pid" ]; then
+		server_stop "$home"
+		return 1
+	fi
+
+	if [ "$scenario" = peap ]; then
+		peap_search
+	else
+		search
+	fi
+
+	server_stop "$pid"
+	server_stop "$home"
+	rm -f "$WORK/detail"
+
+	printf '%s\n    { "scenario": %s, "networks": %s, "workers": %s, "unit": %s,\n      %s,\n      "steps": [ %s ] }' \
+		"$results_sep" "$(json_str "$scenario")" "$BENCH_NETWORKS" "$BENCH_WORKERS" "$(json_str "$unit")" \
+		"${best:-\"max_rate\": 0}" "$(cat "$WORK/steps.json")" >> "$WORK/results.json"
+	results_sep=","
+}
+
+#
+#  PEAP needs eapol_test, and the test certificates.
+#
+EAPOL_TEST=${BENCH_EAPOL_TEST:-$(command -v eapol_test 2>/dev/null)}
+if [ -z "$EAPOL_TEST" ] && [ -x scripts/travis/eapol_test/eapol_test ]; then
+	EAPOL_TEST=scripts/travis/eapol_test/eapol_test
+fi
+
+case " $SCENARIOS " in
+*" peap "*)
+	if [ -z "$EAPOL_TEST" ]; then
+		log "Skipping peap: eapol_test not found.  Set BENCH_EAPOL_TEST, or run scripts/travis/eapol_test-build.sh"
+		SCENARIOS=$(echo "$SCENARIOS" | sed 's/peap//')
+	elif [ ! -f "$RADDB/certs/server.pem" ]; then
+		log "Skipping peap: no certificates.  Run \"make -C $RADDB/certs\""
+		SCENARIOS=$(echo "$SCENARIOS" | sed 's/peap//')
+	fi
+	;;
+esac
+
+results_sep=
+: > "$WORK/results.json"
+
+for scenario in $SCENARIOS; do
+	for networks in $NETWORKS; do
+		for workers in $WORKERS; do
+			run "$scenario" "$networks" "$workers" || log "$scenario: failed"
+		done
+	done
+done
+
+#
+#  Enough about the build and the machine to know whether two sets of
+#  results are comparable.
+#
+version=$($BIN/radiusd -v 2>/dev/null | head -n 1)
+commit=$(git rev-parse HEAD 2>/dev/null)
+cpus=$(getconf _NPROCESSORS_ONLN 2>/dev/null)
+model=$(awk -F': ' '/^model name/ { print $2; exit }' /proc/cpuinfo 2>/dev/null)
+
+{
+	printf '{\n'
+	printf '  "format": 1,\n'
+	printf '  "date": %s,\n' "$(json_str "$(date -u +%Y-%m-%dT%H:%M:%SZ)")"
+	printf '  "version": %s,\n' "$(json_str "$version")"
+	printf '  "commit": %s,\n' "$(json_str "$commit")"
+	printf '  "host": { "name": %s, "os": %s, "cpus": %s, "cpu_model": %s },\n' \
+		"$(json_str "$(uname -n)")" "$(json_str "$(uname -srm)")" "$(json_num "$cpus")" "$(json_str "$model")"
+	printf '  "settings": { "duration": %s, "precision_percent": %s, "max_p99_ms": %s, "client_threads": %s, "home_workers": %s },\n' \
+		"$DURATION" "$PRECISION" "$MAX_P99" "$CLIENT_THREADS" "$HOME_WORKERS"
+	printf '  "results": ['
+	cat "$WORK/results.json"
+	printf '\n  ]\n}\n'
+} > "${OUTPUT:-/dev/stdout}"
@@ -0,0 +1,3 @@
+#
+#  Test the "attr_filter" module
+#
@@ -0,0 +1 @@
+cache_lfu.test:
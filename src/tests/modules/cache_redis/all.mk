@@ -0,0 +1,11 @@
+#
+#  Test the "cache_redis" driver
+#
+
+#  MODULE.test is the main target for this module.
+
+# Don't test cache_redis if CACHE_REDIS_TEST_SERVER ENV is not set
+cache_redis_require_test_server := 1
+
+cache_redis.test:
+	${Q}echo OK: cache_redis.test
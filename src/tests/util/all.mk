@@ -1,8 +1,67 @@
-SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk control_test.mk 
+SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk control_test.mk hash_test.mk trie_test.mk encode_test.mk
+
+#
+#  Tests which check their own results, and exit non-zero on failure.
+#
+TESTS.UTIL := hash_test trie_test encode_test
+
+.PHONY: $(BUILD_DIR)/tests/util
+$(BUILD_DIR)/tests/util:
+	${Q}mkdir -p $@
+
+$(BUILD_DIR)/tests/util/%: $(TESTBINDIR)/% | $(BUILD_DIR)/tests/util
+	${Q}echo UTIL-TEST $(notdir $@)
+	${Q}if ! $(TESTBIN)/$(notdir $@) > $@.log; then \
+		cat $@.log; \
+		echo "$(TESTBIN)/$(notdir $@)"; \
+		exit 1; \
+	fi
+	${Q}touch $@
+
+TESTS.UTIL_FILES := $(addprefix $(BUILD_DIR)/tests/util/,$(TESTS.UTIL))
+
+tests.util: $(TESTS.UTIL_FILES)
 
 #
 #  These require pthread.
 #
 ifneq "$(findstring thread,${CFLAGS})" ""
-SUBMAKEFILES += channel_test.mk worker_test.mk radius1_test.mk schedule_test.mk radius_schedule_test.mk
+SUBMAKEFILES += channel_test.mk worker_test.mk radius1_test.mk schedule_test.mk radius_schedule_test.mk io_bench.mk radius_codec_bench.mk
+
+#
+#  Micro-benchmarks for the I/O primitives.  Each line of output is
+#  one benchmark, as "key=value" pairs.  The thread counts are fixed
+#  so that results are comparable between runs.
+#
+BENCH_THREADS	:= 1:1 2:2 4:4
+
+.PHONY: bench bench.io
+bench.io: $(TESTBINDIR)/io_bench
+	${Q}for pc in $(BENCH_THREADS); do \
+		$(TESTBIN)/io_bench -p $${pc%%:*} -c $${pc##*:} atomic_queue || exit 1; \
+		$(TESTBIN)/io_bench -p $${pc%%:*} -c $${pc##*:} -B 16 atomic_queue || exit 1; \
+	done
+	${Q}$(TESTBIN)/io_bench ring_buffer message_set
+
+#
+#  The RADIUS decoder and encoder, over the unit test vectors.  Each
+#  line of output is one class of packet.  Captures from radsniff
+#  can be benchmarked by running radius_codec_bench by hand.
+#
+CODEC_BENCH_FILES := $(addprefix $(top_srcdir)/src/tests/unit/,rfc.txt vendor.txt extended.txt lucent.txt \
+			wimax.txt tlv.txt tunnel.txt unknown.txt)
+
+.PHONY: bench.codec
+bench.codec: $(TESTBINDIR)/radius_codec_bench $(BUILD_DIR)/share/dictionary
+	${Q}$(TESTBIN)/radius_codec_bench -D $(BUILD_DIR)/share $(CODEC_BENCH_FILES)
+
+bench: bench.io bench.codec
+
+#
+#  The same packets, one per file, as a seed corpus for fuzzers.
+#
+.PHONY: corpus.radius
+corpus.radius: $(TESTBINDIR)/radius_codec_bench $(BUILD_DIR)/share/dictionary
+	${Q}mkdir -p $(BUILD_DIR)/tests/corpus/radius
+	${Q}$(TESTBIN)/radius_codec_bench -D $(BUILD_DIR)/share -w $(BUILD_DIR)/tests/corpus/radius $(CODEC_BENCH_FILES)
 endif
@@ -77,7 +77,7 @@ int main(int argc, char *argv[])
 	int c, i, rcode = 0;
 	int size;
 	intptr_t val;
-	void *data;
+	void *data, **array;
 	fr_atomic_queue_t *aq;
 	TALLOC_CTX	*autofree = talloc_init("main");
 
@@ -183,6 +183,70 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+#ifndef NDEBUG
+	if (debug_lvl) {
+		printf("Empty\n");
+		fr_atomic_queue_debug(aq, stdout);
+
+		if (debug_lvl > 1) printf("Bulk filling with %d\n", size);
+	}
+#endif
+
+	/*
+	 *	Push more than fits.  Only "size" entries go in.
+	 */
+	array = talloc_array(autofree, void *, size + 1);
+	for (i = 0; i < (size + 1); i++) {
+		val = i + OFFSET;
+		array[i] = (void *) val;
+	}
+
+	c = fr_atomic_queue_push_n(aq, array, size + 1);
+	if (c != size) {
+		fprintf(stderr, "Bulk push expected %d, got %d\n", size, c);
+		exit(1);
+	}
+
+	if (fr_atomic_queue_push_n(aq, array, 1) != 0) {
+		fprintf(stderr, "Bulk pushed an entry past the end of the queue.");
+		exit(1);
+	}
+
+	/*
+	 *	Pop them in odd-sized chunks, so that the reads wrap
+	 *	around the end of the queue.
+	 */
+	for (i = 0; i < size; i += c) {
+		int j;
+
+		memset(array, 0, sizeof(array[0]) * (size + 1));
+
+		c = fr_atomic_queue_pop_n(aq, array, 3);
+		if (c <= 0) {
+			fprintf(stderr, "Failed bulk popping at %d\n", i);
+			exit(1);
+		}
+
+		for (j = 0; j < c; j++) {
+			val = (intptr_t) array[j];
+			if (val != (i + j + OFFSET)) {
+				fprintf(stderr, "Bulk pop expected %d, got %d\n",
+					i + j + OFFSET, (int) val);
+				exit(1);
+			}
+		}
+	}
+
+	if (i != size) {
+		fprintf(stderr, "Bulk popped %d entries, expected %d\n", i, size);
+		exit(1);
+	}
+
+	if (fr_atomic_queue_pop_n(aq, array, size) != 0) {
+		fprintf(stderr, "Bulk popped an entry past the end of the queue.");
+		exit(1);
+	}
+
 #ifndef NDEBUG
 	if (debug_lvl) {
 		printf("Empty\n");
@@ -0,0 +1,376 @@
+/*
+ * encode_test.c	Compare base64, hex and UTF-8 functions with the
+ *			byte at a time versions they replaced.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2026  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/base64.h>
+
+#include <ctype.h>
+
+#define TEST_CHECK(_x) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "%s[%d]: \"%s\" failed (seed %u)\n", __FILE__, __LINE__, #_x, seed); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+#define NUM_ROUNDS	(20000)
+#define MAX_LEN		(200)
+
+static uint32_t		rand_state;
+static uint32_t		seed;
+
+static char const	b64str[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static char const	hextab[] = "0123456789abcdef";
+static signed char	b64[UINT8_MAX + 1];
+
+/*
+ *	xorshift, so that failures can be repeated.
+ */
+static uint32_t test_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+
+	return rand_state;
+}
+
+/*
+ *	The versions from before the functions worked on more than
+ *	one byte at a time.
+ */
+static size_t old_base64_encode(char *out, size_t outlen, uint8_t const *in, size_t inlen)
+{
+	char *p = out;
+	if (outlen < (FR_BASE64_ENC_LENGTH(inlen) + 1)) {
+		*out = '\0';
+		return -1;
+	}
+
+	while (inlen) {
+		*p++ = b64str[(in[0] >> 2) & 0x3f];
+		*p++ = b64str[((in[0] << 4) + (--inlen ? in[1] >> 4 : 0)) & 0x3f];
+		*p++ = (inlen ? b64str[((in[1] << 2) + (--inlen ? in[2] >> 6 : 0)) & 0x3f] : '=');
+		*p++ = inlen ? b64str[in[2] & 0x3f] : '=';
+
+		if (inlen) inlen--;
+		if (inlen) in += 3;
+	}
+
+	p[0] = '\0';
+
+	return p - out;
+}
+
+#define us(x) (uint8_t) x
+
+static bool old_is_base64(char c)
+{
+	return b64[us(c)] >= 0;
+}
+
+static ssize_t old_base64_decode(uint8_t *out, size_t outlen, char const *in, size_t inlen)
+{
+	uint8_t *p = out;
+
+	if (outlen <  FR_BASE64_DEC_LENGTH(inlen)) {
+		return -1;
+	}
+
+	while (inlen >= 2) {
+		if (!old_is_base64(in[0]) || !old_is_base64(in[1])) {
+			break;
+		}
+
+		*p++ = ((b64[us(in[0])] << 2) | (b64[us(in[1])] >> 4));
+
+		if (inlen == 2) break;
+
+		if (in[2] == '=') {
+			if ((inlen != 4) || (in[3] != '=')) break;
+		} else {
+			if (!old_is_base64(in[2])) break;
+
+			*p++ = ((b64[us(in[1])] << 4) & 0xf0) | (b64[us(in[2])] >> 2);
+
+			if (inlen == 3) break;
+
+			if (in[3] == '=') {
+				if (inlen != 4) break;
+			} else {
+				if (!old_is_base64(in[3])) break;
+
+				*p++ = ((b64[us(in[2])] << 6) & 0xc0) | b64[us(in[3])];
+			}
+		}
+
+		in += 4;
+		inlen -= 4;
+	}
+
+	if (inlen != 0) {
+		return -1;
+	}
+
+	return p - out;
+}
+
+static size_t old_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen)
+{
+	size_t i;
+	size_t len;
+	char *c1, *c2;
+
+	len = inlen >> 1;
+	if (len > outlen) len = outlen;
+
+	for (i = 0; i < len; i++) {
+		if(!(c1 = memchr(hextab, tolower((int) hex[i << 1]), sizeof(hextab))) ||
+		   !(c2 = memchr(hextab, tolower((int) hex[(i << 1) + 1]), sizeof(hextab))))
+			break;
+		bin[i] = ((c1-hextab)<<4) + (c2-hextab);
+	}
+
+	return i;
+}
+
+static ssize_t old_utf8_str(uint8_t const *str, ssize_t inlen)
+{
+	uint8_t const *p, *end;
+	size_t len;
+
+	len = inlen < 0 ? strlen((char const *)str) : (size_t) inlen;
+
+	p = str;
+	end = p + len;
+
+	do {
+		size_t clen;
+
+		clen = fr_utf8_char(p, end - p);
+		if (clen == 0) return end - p;
+		p += clen;
+	} while (p < end);
+
+	return inlen;
+}
+
+/*
+ *	Lengths around the 3, 4, 8 and 16 byte blocks the new code
+ *	works on.
+ */
+static size_t rand_len(void)
+{
+	if (test_rand() & 0x01) return test_rand() % 40;
+
+	return test_rand() % MAX_LEN;
+}
+
+/*
+ *	Exactly "len" bytes, so that reads past the end can be caught
+ *	by the memory checkers.
+ */
+static uint8_t *buffer_alloc(size_t len)
+{
+	uint8_t *buff;
+
+	buff = talloc_array(NULL, uint8_t, len ? len : 1);
+	TEST_CHECK(buff != NULL);
+
+	return buff;
+}
+
+static void test_base64_encode(void)
+{
+	uint8_t	*in;
+	char	out_new[FR_BASE64_ENC_LENGTH(MAX_LEN) + 1], out_old[FR_BASE64_ENC_LENGTH(MAX_LEN) + 1];
+	size_t	inlen, i, ret;
+
+	inlen = rand_len();
+	in = buffer_alloc(inlen);
+	for (i = 0; i < inlen; i++) in[i] = test_rand();
+
+	ret = fr_base64_encode(out_new, sizeof(out_new), in, inlen);
+	TEST_CHECK(ret == old_base64_encode(out_old, sizeof(out_old), in, inlen));
+	TEST_CHECK(ret == FR_BASE64_ENC_LENGTH(inlen));
+	TEST_CHECK(strcmp(out_new, out_old) == 0);
+
+	/*
+	 *	No room for the terminating '\0'.
+	 */
+	TEST_CHECK(fr_base64_encode(out_new, ret, in, inlen) == (size_t) -1);
+
+	talloc_free(in);
+}
+
+static void test_base64_decode(void)
+{
+	uint8_t	data[MAX_LEN];
+	uint8_t	out_new[MAX_LEN], out_old[MAX_LEN];
+	char	encoded[FR_BASE64_ENC_LENGTH(MAX_LEN) + 1];
+	char	*in;
+	size_t	datalen, inlen, i;
+	ssize_t	ret;
+
+	datalen = rand_len();
+	for (i = 0; i < datalen; i++) data[i] = test_rand();
+	inlen = fr_base64_encode(encoded, sizeof(encoded), data, datalen);
+
+	/*
+	 *	Sometimes leave it alone, sometimes break it.
+	 */
+	switch (test_rand() % 4) {
+	case 0:
+		break;
+
+	case 1:
+		if (inlen) encoded[test_rand() % inlen] = test_rand();
+		break;
+
+	case 2:
+		if (inlen) encoded[test_rand() % inlen] = "=\n -_"[test_rand() % 5];
+		break;
+
+	case 3:
+		if (inlen) inlen -= test_rand() % 4 % (inlen + 1);
+		break;
+	}
+
+	in = (char *) buffer_alloc(inlen);
+	memcpy(in, encoded, inlen);
+
+	ret = fr_base64_decode(out_new, sizeof(out_new), in, inlen);
+	TEST_CHECK(ret == old_base64_decode(out_old, sizeof(out_old), in, inlen));
+	if (ret > 0) TEST_CHECK(memcmp(out_new, out_old, ret) == 0);
+
+	talloc_free(in);
+}
+
+static void test_hex2bin(void)
+{
+	static char const chars[] = "0123456789abcdefABCDEF0123456789abcdefABCDEFgG/:@`\x7f\x80\xb0\xe6 ";
+	uint8_t	out_new[MAX_LEN], out_old[MAX_LEN];
+	char	*in;
+	size_t	inlen, outlen, i, ret;
+	bool	valid;
+
+	inlen = rand_len();
+	outlen = test_rand() % (MAX_LEN + 1);
+	valid = (test_rand() % 4) != 0;
+
+	in = (char *) buffer_alloc(inlen);
+	for (i = 0; i < inlen; i++) {
+		in[i] = chars[test_rand() % (valid ? 22 : (sizeof(chars) - 1))];
+	}
+
+	ret = fr_hex2bin(out_new, outlen, in, inlen);
+	TEST_CHECK(ret == old_hex2bin(out_old, outlen, in, inlen));
+	TEST_CHECK(memcmp(out_new, out_old, ret) == 0);
+
+	talloc_free(in);
+}
+
+static void test_utf8_str(void)
+{
+	static char const *chars[] = {
+		"a", "Z", " ", "~", "0", "%", "\x7f", "\x1f", "\t", "\x01",
+		"\xc2\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xed\x9f\xbf", "\xf4\x8f\xbf\xbf",
+		"\xc0\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\x80", "\xff", "\xe2\x82", "\xf0\x9f"
+	};
+	uint8_t	*in;
+	size_t	inlen = 0, len, i;
+	char	buff[MAX_LEN + 1];
+	int	ascii;
+
+	/*
+	 *	Mostly printable ASCII, in runs which are longer or
+	 *	shorter than the blocks, with other characters between
+	 *	them.
+	 */
+	len = rand_len();
+	ascii = test_rand() % 4;
+	while (inlen < len) {
+		char const *c;
+
+		if ((test_rand() % 8) < (unsigned int) ascii + 4) {
+			c = chars[test_rand() % 6];
+		} else {
+			c = chars[test_rand() % (sizeof(chars) / sizeof(chars[0]))];
+		}
+
+		if ((inlen + strlen(c)) > len) break;
+
+		memcpy(buff + inlen, c, strlen(c));
+		inlen += strlen(c);
+	}
+	buff[inlen] = '\0';
+
+	in = buffer_alloc(inlen);
+	memcpy(in, buff, inlen);
+	TEST_CHECK(fr_utf8_str(in, inlen) == old_utf8_str(in, inlen));
+	talloc_free(in);
+
+	in = buffer_alloc(inlen + 1);
+	memcpy(in, buff, inlen + 1);
+	TEST_CHECK(fr_utf8_str(in, -1) == old_utf8_str(in, -1));
+
+	/*
+	 *	Only part of the buffer.
+	 */
+	for (i = 0; i < inlen; i += 1 + (test_rand() % 17)) {
+		TEST_CHECK(fr_utf8_str(in, i) == old_utf8_str(in, i));
+	}
+	talloc_free(in);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t	i;
+	uint8_t	out[8];
+
+	seed = (argc > 1) ? strtoul(argv[1], NULL, 10) : 0x12345678;
+	rand_state = seed ? seed : 1;
+
+	memset(b64, -1, sizeof(b64));
+	for (i = 0; i < sizeof(b64str) - 1; i++) b64[us(b64str[i])] = i;
+
+	for (i = 0; i < NUM_ROUNDS; i++) {
+		test_base64_encode();
+		test_base64_decode();
+		test_hex2bin();
+		test_utf8_str();
+	}
+
+	/*
+	 *	The only difference.  The old fr_hex2bin() found '\0'
+	 *	in hextab, and took it as a digit with value 16.
+	 */
+	TEST_CHECK(fr_hex2bin(out, sizeof(out), "0a\0" "1bc2d3e4f5a6b7c8", 18) == 1);
+	TEST_CHECK(out[0] == 0x0a);
+
+	printf("OK\n");
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,6 @@
+TARGET := encode_test
+
+SOURCES		:= encode_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,291 @@
+/*
+ * hash_test.c	Tests for hash tables
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2026  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#define TEST_CHECK(_x) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "%s: %s[%d]: \"%s\" failed\n", type_name, __FILE__, __LINE__, #_x); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+#define NUM_KEYS	(100000)
+#define NUM_COLLIDE	(1000)
+
+static int		*keys;
+static char const	*type_name;
+static int		num_freed;
+
+static uint32_t hash_int(void const *data)
+{
+	return fr_hash(data, sizeof(int));
+}
+
+/*
+ *	Every key has the same hash, so every entry is on one chain,
+ *	or one probe sequence.
+ */
+static uint32_t hash_same(UNUSED void const *data)
+{
+	return 0x12345678;
+}
+
+/*
+ *	Eight different hashes, with more than one bucket or group
+ *	in use.
+ */
+static uint32_t hash_few(void const *data)
+{
+	return (*(int const *)data & 0x07) << 5;
+}
+
+static int cmp_int(void const *one, void const *two)
+{
+	int a = *(int const *)one;
+	int b = *(int const *)two;
+
+	return (a > b) - (a < b);
+}
+
+static void free_int(UNUSED void *data)
+{
+	num_freed++;
+}
+
+static int walk_count(void *ctx, void *data)
+{
+	uint8_t *seen = ctx;
+
+	seen[*(int *)data]++;
+
+	return 0;
+}
+
+static fr_hash_table_t *table_alloc(fr_hash_table_type_t type, fr_hash_table_hash_t hash)
+{
+	fr_hash_table_t *ht;
+
+	ht = fr_hash_table_create_type(NULL, type, hash, cmp_int, free_int);
+	TEST_CHECK(ht != NULL);
+	TEST_CHECK(fr_hash_table_num_elements(ht) == 0);
+
+	return ht;
+}
+
+/*
+ *	Insert, find, and refuse duplicates.
+ */
+static void test_insert(fr_hash_table_type_t type)
+{
+	fr_hash_table_t	*ht = table_alloc(type, hash_int);
+	int		i, missing = NUM_KEYS;
+
+	for (i = 0; i < NUM_KEYS; i++) TEST_CHECK(fr_hash_table_insert(ht, &keys[i]) == 1);
+	TEST_CHECK(fr_hash_table_num_elements(ht) == NUM_KEYS);
+
+	for (i = 0; i < NUM_KEYS; i++) {
+		int copy = i;
+
+		TEST_CHECK(fr_hash_table_insert(ht, &copy) == 0);
+		TEST_CHECK(fr_hash_table_finddata(ht, &copy) == &keys[i]);
+	}
+	TEST_CHECK(fr_hash_table_num_elements(ht) == NUM_KEYS);
+	TEST_CHECK(fr_hash_table_finddata(ht, &missing) == NULL);
+
+	fr_hash_table_free(ht);
+}
+
+/*
+ *	Delete and yank, and check the free callback is only called
+ *	on delete.
+ */
+static void test_delete(fr_hash_table_type_t type)
+{
+	fr_hash_table_t	*ht = table_alloc(type, hash_int);
+	int		i;
+
+	for (i = 0; i < NUM_KEYS; i++) TEST_CHECK(fr_hash_table_insert(ht, &keys[i]) == 1);
+
+	num_freed = 0;
+	for (i = 0; i < NUM_KEYS; i += 2) TEST_CHECK(fr_hash_table_delete(ht, &keys[i]) == 1);
+	TEST_CHECK(num_freed == (NUM_KEYS / 2));
+
+	for (i = 1; i < NUM_KEYS; i += 4) TEST_CHECK(fr_hash_table_yank(ht, &keys[i]) == &keys[i]);
+	TEST_CHECK(num_freed == (NUM_KEYS / 2));
+	TEST_CHECK(fr_hash_table_num_elements(ht) == (NUM_KEYS / 4));
+
+	for (i = 0; i < NUM_KEYS; i++) {
+		if ((i & 0x03) == 3) {
+			TEST_CHECK(fr_hash_table_finddata(ht, &keys[i]) == &keys[i]);
+		} else {
+			TEST_CHECK(fr_hash_table_finddata(ht, &keys[i]) == NULL);
+			TEST_CHECK(fr_hash_table_delete(ht, &keys[i]) == 0);
+		}
+	}
+
+	/*
+	 *	Replace frees the old data.
+	 */
+	num_freed = 0;
+	TEST_CHECK(fr_hash_table_replace(ht, &keys[3]) == 1);
+	TEST_CHECK(num_freed == 1);
+	TEST_CHECK(fr_hash_table_replace(ht, &keys[0]) == 1);
+	TEST_CHECK(num_freed == 1);
+	TEST_CHECK(fr_hash_table_finddata(ht, &keys[0]) == &keys[0]);
+
+	num_freed = 0;
+	fr_hash_table_free(ht);
+	TEST_CHECK(num_freed == (NUM_KEYS / 4) + 1);
+}
+
+/*
+ *	Entries deleted from a table should make room for new ones,
+ *	so a table with the same number of entries doesn't grow, no
+ *	matter how many are deleted and inserted.
+ */
+static void test_tombstone(fr_hash_table_type_t type)
+{
+	fr_hash_table_t	*ht = table_alloc(type, hash_int);
+	int		i, live = 40;
+	size_t		size;
+
+	for (i = 0; i < live; i++) TEST_CHECK(fr_hash_table_insert(ht, &keys[i]) == 1);
+	size = talloc_total_size(ht);
+
+	for (i = 0; i < (NUM_KEYS - live); i++) {
+		TEST_CHECK(fr_hash_table_delete(ht, &keys[i]) == 1);
+		TEST_CHECK(fr_hash_table_insert(ht, &keys[i + live]) == 1);
+		TEST_CHECK(fr_hash_table_finddata(ht, &keys[i]) == NULL);
+	}
+	TEST_CHECK(fr_hash_table_num_elements(ht) == live);
+	TEST_CHECK(talloc_total_size(ht) == size);
+
+	for (i = NUM_KEYS - live; i < NUM_KEYS; i++) TEST_CHECK(fr_hash_table_finddata(ht, &keys[i]) == &keys[i]);
+
+	fr_hash_table_free(ht);
+}
+
+/*
+ *	Grow from the initial size, and check nothing is lost or
+ *	duplicated on the way.
+ */
+static void test_grow(fr_hash_table_type_t type)
+{
+	fr_hash_table_t	*ht = table_alloc(type, hash_int);
+	uint8_t		*seen;
+	int		i;
+
+	seen = talloc_zero_array(NULL, uint8_t, NUM_KEYS);
+	TEST_CHECK(seen != NULL);
+
+	for (i = 0; i < NUM_KEYS; i++) {
+		TEST_CHECK(fr_hash_table_insert(ht, &keys[i]) == 1);
+
+		/*
+		 *	Entries inserted before the table grew are
+		 *	still there afterwards.
+		 */
+		if ((i & (i - 1)) == 0) {
+			int j;
+
+			for (j = 0; j <= i; j++) TEST_CHECK(fr_hash_table_finddata(ht, &keys[j]) == &keys[j]);
+		}
+	}
+
+	TEST_CHECK(fr_hash_table_walk(ht, walk_count, seen) == 0);
+	for (i = 0; i < NUM_KEYS; i++) TEST_CHECK(seen[i] == 1);
+
+	talloc_free(seen);
+	fr_hash_table_free(ht);
+}
+
+/*
+ *	Keys with the same hash are told apart by the compare
+ *	function, whatever order they're inserted and deleted in.
+ */
+static void test_collisions(fr_hash_table_type_t type, fr_hash_table_hash_t hash)
+{
+	fr_hash_table_t	*ht = table_alloc(type, hash);
+	int		i;
+
+	/*
+	 *	Descending, then ascending, so that new entries go at
+	 *	both ends of a chain.
+	 */
+	for (i = (NUM_COLLIDE / 2) - 1; i >= 0; i--) TEST_CHECK(fr_hash_table_insert(ht, &keys[i]) == 1);
+	for (i = NUM_COLLIDE / 2; i < NUM_COLLIDE; i++) TEST_CHECK(fr_hash_table_insert(ht, &keys[i]) == 1);
+	TEST_CHECK(fr_hash_table_num_elements(ht) == NUM_COLLIDE);
+
+	for (i = 0; i < NUM_COLLIDE; i++) {
+		TEST_CHECK(fr_hash_table_finddata(ht, &keys[i]) == &keys[i]);
+		TEST_CHECK(fr_hash_table_insert(ht, &keys[i]) == 0);
+	}
+
+	for (i = 0; i < NUM_COLLIDE; i += 3) TEST_CHECK(fr_hash_table_delete(ht, &keys[i]) == 1);
+
+	for (i = 0; i < NUM_COLLIDE; i++) {
+		TEST_CHECK(fr_hash_table_finddata(ht, &keys[i]) == (((i % 3) == 0) ? NULL : &keys[i]));
+	}
+
+	for (i = 0; i < NUM_COLLIDE; i += 3) TEST_CHECK(fr_hash_table_insert(ht, &keys[i]) == 1);
+	for (i = 0; i < NUM_COLLIDE; i++) TEST_CHECK(fr_hash_table_finddata(ht, &keys[i]) == &keys[i]);
+	TEST_CHECK(fr_hash_table_num_elements(ht) == NUM_COLLIDE);
+
+	fr_hash_table_free(ht);
+}
+
+int main(UNUSED int argc, UNUSED char *argv[])
+{
+	static struct {
+		fr_hash_table_type_t	type;
+		char const		*name;
+	} types[] = {
+		{ FR_HASH_TABLE_OPEN,	"open" },
+		{ FR_HASH_TABLE_SPLIT,	"split" }
+	};
+	size_t	i;
+	int	j;
+
+	keys = talloc_array(NULL, int, NUM_KEYS);
+	if (!keys) return EXIT_FAILURE;
+	for (j = 0; j < NUM_KEYS; j++) keys[j] = j;
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		type_name = types[i].name;
+
+		test_insert(types[i].type);
+		test_delete(types[i].type);
+		test_tombstone(types[i].type);
+		test_grow(types[i].type);
+		test_collisions(types[i].type, hash_same);
+		test_collisions(types[i].type, hash_few);
+
+		printf("%s: OK\n", type_name);
+	}
+
+	talloc_free(keys);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,487 @@
+/*
+ * io_bench.c	Micro-benchmarks for the I/O primitives
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/io/atomic_queue.h>
+#include <freeradius-devel/io/ring_buffer.h>
+#include <freeradius-devel/io/message.h>
+#include <freeradius-devel/io/time.h>
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <sched.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#define MAX_THREADS	(64)
+
+#define MPRINT1 if (debug_lvl) printf
+
+static int		debug_lvl = 0;
+static int		num_producers = 1;
+static int		num_consumers = 1;
+static int		num_ops = 1000000;
+static int		queue_size = 1024;
+static size_t		packet_size = 256;
+static int		max_outstanding = 64;
+static int		burst = 1;
+
+/*
+ *	One histogram per thread, so that each has a single writer.
+ */
+typedef struct fr_bench_thread_t {
+	int			id;
+	fr_atomic_queue_t	*aq;
+	fr_time_histogram_t	latency;		//!< per-operation latency
+	uint64_t		ops;			//!< operations completed
+	uint64_t		retries;		//!< pushes / pops which failed, and were retried
+} fr_bench_thread_t;
+
+/*
+ *	Consumers stop when this reaches the total number of pushes.
+ */
+static atomic_ullong	popped;
+
+
+/**********************************************************************/
+typedef struct rad_request REQUEST;
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx);
+void verify_request(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request);
+void talloc_const_free(void const *ptr);
+
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx)
+{
+	return NULL;
+}
+
+void verify_request(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request)
+{
+}
+
+void talloc_const_free(void const *ptr)
+{
+	void *tmp;
+	if (!ptr) return;
+
+	memcpy(&tmp, &ptr, sizeof(tmp));
+	talloc_free(tmp);
+}
+/**********************************************************************/
+
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: io_bench [OPTS] [atomic_queue | ring_buffer | message_set ...]\n");
+	fprintf(stderr, "  -B <burst>             Use the bulk atomic queue API, with this many entries per call.\n");
+	fprintf(stderr, "  -c <consumers>         Number of atomic queue consumer threads.\n");
+	fprintf(stderr, "  -n <ops>               Number of operations per producer.\n");
+	fprintf(stderr, "  -o <outstanding>       Buffers held before the oldest one is freed.\n");
+	fprintf(stderr, "  -p <producers>         Number of atomic queue producer threads.\n");
+	fprintf(stderr, "  -P <size>              Packet size for ring buffers and message sets.\n");
+	fprintf(stderr, "  -s <size>              Atomic queue size.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/** Print one result line
+ *
+ *  The output is one line of "key=value" pairs per benchmark, so that
+ *  runs can be compared with a simple script.  All times are in
+ *  nanoseconds.
+ */
+static void bench_report(char const *name, int producers, int consumers,
+			 fr_bench_thread_t *threads, int num_threads, fr_time_t elapsed)
+{
+	int i;
+	uint64_t ops = 0, retries = 0;
+	fr_time_histogram_t *h;
+
+	h = talloc_zero(NULL, fr_time_histogram_t);
+	if (!h) exit(1);
+
+	for (i = 0; i < num_threads; i++) {
+		ops += threads[i].ops;
+		retries += threads[i].retries;
+		fr_time_histogram_merge(h, &threads[i].latency);
+	}
+
+	if (!elapsed) elapsed = 1;
+	if (!ops) ops = 1;
+
+	printf("bench=%s producers=%d consumers=%d burst=%d ops=%" PRIu64 " retries=%" PRIu64
+	       " elapsed_ns=%" PRIu64 " ns_per_op=%.2f ops_per_sec=%.0f"
+	       " p50_ns=%" PRIu64 " p99_ns=%" PRIu64 " p999_ns=%" PRIu64 " max_ns=%" PRIu64 "\n",
+	       name, producers, consumers, burst, ops, retries,
+	       elapsed, ((double) elapsed) / ops, ((double) ops * NANOSEC) / elapsed,
+	       fr_time_histogram_percentile(h, 50.0),
+	       fr_time_histogram_percentile(h, 99.0),
+	       fr_time_histogram_percentile(h, 99.9),
+	       fr_time_histogram_percentile(h, 100.0));
+
+	if (debug_lvl) fr_time_histogram_debug(h, name, stdout);
+
+	talloc_free(h);
+}
+
+static void *aq_producer(void *arg)
+{
+	int i, j, num;
+	fr_bench_thread_t *bt = arg;
+	fr_time_t start, end;
+	void *data[burst];
+
+	for (i = 0; i < num_ops; i += num) {
+		num = burst;
+		if (num > (num_ops - i)) num = num_ops - i;
+
+		for (j = 0; j < num; j++) {
+			intptr_t val = i + j + 1;
+
+			data[j] = (void *) val;
+		}
+
+		start = fr_time();
+		if (burst == 1) {
+			while (!fr_atomic_queue_push(bt->aq, data[0])) {
+				bt->retries++;
+				(void) sched_yield();
+				start = fr_time();
+			}
+		} else {
+			while ((num = fr_atomic_queue_push_n(bt->aq, data, num)) == 0) {
+				bt->retries++;
+				(void) sched_yield();
+				start = fr_time();
+				num = burst;
+				if (num > (num_ops - i)) num = num_ops - i;
+			}
+		}
+		end = fr_time();
+
+		fr_time_histogram_add(&bt->latency, end - start);
+		bt->ops += num;
+	}
+
+	return NULL;
+}
+
+static void *aq_consumer(void *arg)
+{
+	int num;
+	fr_bench_thread_t *bt = arg;
+	uint64_t total = (uint64_t) num_producers * num_ops;
+	fr_time_t start, end;
+	void *data[burst];
+
+	while (atomic_load_explicit(&popped, memory_order_relaxed) < total) {
+		start = fr_time();
+		if (burst == 1) {
+			num = fr_atomic_queue_pop(bt->aq, &data[0]);
+		} else {
+			num = fr_atomic_queue_pop_n(bt->aq, data, burst);
+		}
+		if (!num) {
+			bt->retries++;
+			(void) sched_yield();
+			continue;
+		}
+		end = fr_time();
+
+		fr_time_histogram_add(&bt->latency, end - start);
+		bt->ops += num;
+		atomic_fetch_add_explicit(&popped, num, memory_order_relaxed);
+	}
+
+	return NULL;
+}
+
+/** Push and pop through one atomic queue from multiple threads
+ *
+ *  Producer and consumer latencies are reported separately, as
+ *  "atomic_queue_push" and "atomic_queue_pop".  The latency is that of
+ *  a successful push or pop call, which moves "burst" entries when the
+ *  bulk API is used.  A full or empty queue yields the CPU, and
+ *  is counted as a retry, rather than as time spent in the queue.
+ */
+static int bench_atomic_queue(TALLOC_CTX *ctx)
+{
+	int i, num_threads;
+	fr_atomic_queue_t *aq;
+	fr_bench_thread_t *threads;
+	pthread_t ids[MAX_THREADS];
+	fr_time_t start, end;
+
+	num_threads = num_producers + num_consumers;
+
+	aq = fr_atomic_queue_create(ctx, queue_size);
+	if (!aq) {
+		fprintf(stderr, "io_bench: Failed creating atomic queue\n");
+		return -1;
+	}
+
+	threads = talloc_zero_array(ctx, fr_bench_thread_t, num_threads);
+	if (!threads) return -1;
+
+	atomic_store(&popped, 0);
+
+	start = fr_time();
+	for (i = 0; i < num_threads; i++) {
+		threads[i].id = i;
+		threads[i].aq = aq;
+
+		(void) pthread_create(&ids[i], NULL, (i < num_producers) ? aq_producer : aq_consumer, &threads[i]);
+	}
+
+	for (i = 0; i < num_threads; i++) (void) pthread_join(ids[i], NULL);
+	end = fr_time();
+
+	bench_report("atomic_queue_push", num_producers, num_consumers, threads, num_producers, end - start);
+	bench_report("atomic_queue_pop", num_producers, num_consumers, threads + num_producers, num_consumers, end - start);
+
+	talloc_free(threads);
+	talloc_free(aq);
+	return 0;
+}
+
+/** Allocate and free packets from a ring buffer
+ *
+ *  Ring buffers have a single owner, so this runs in one thread.  The
+ *  oldest buffer is freed once "max_outstanding" buffers are in use,
+ *  which is the pattern the network side uses.  The latency is that
+ *  of one alloc / free pair.
+ */
+static int bench_ring_buffer(TALLOC_CTX *ctx)
+{
+	int i, outstanding = 0;
+	fr_ring_buffer_t *rb;
+	fr_bench_thread_t *bt;
+	fr_time_t start, end, op_start;
+
+	rb = fr_ring_buffer_create(ctx, packet_size * max_outstanding * 4);
+	if (!rb) {
+		fprintf(stderr, "io_bench: Failed creating ring buffer\n");
+		return -1;
+	}
+
+	bt = talloc_zero(ctx, fr_bench_thread_t);
+	if (!bt) return -1;
+
+	start = fr_time();
+	for (i = 0; i < num_ops; i++) {
+		op_start = fr_time();
+
+		if (outstanding == max_outstanding) {
+			(void) fr_ring_buffer_free(rb, packet_size);
+			outstanding--;
+		}
+
+		if (!fr_ring_buffer_alloc(rb, packet_size)) {
+			fprintf(stderr, "io_bench: Failed allocating from ring buffer at %d\n", i);
+			return -1;
+		}
+		outstanding++;
+
+		fr_time_histogram_add(&bt->latency, fr_time() - op_start);
+		bt->ops++;
+	}
+	end = fr_time();
+
+	bench_report("ring_buffer", 1, 0, bt, 1, end - start);
+
+	talloc_free(bt);
+	talloc_free(rb);
+	return 0;
+}
+
+/** Reserve, allocate, and release messages from a message set
+ *
+ *  The latency is that of one reserve / alloc / done cycle, including
+ *  any garbage collection it triggers.
+ */
+static int bench_message_set(TALLOC_CTX *ctx)
+{
+	int i, head = 0;
+	fr_message_set_t *ms;
+	fr_message_t **window;
+	fr_bench_thread_t *bt;
+	fr_time_t start, end, op_start;
+
+	ms = fr_message_set_create(ctx, max_outstanding * 2, sizeof(fr_message_t), packet_size * max_outstanding * 4);
+	if (!ms) {
+		fprintf(stderr, "io_bench: Failed creating message set: %s\n", fr_strerror());
+		return -1;
+	}
+
+	window = talloc_zero_array(ctx, fr_message_t *, max_outstanding);
+	bt = talloc_zero(ctx, fr_bench_thread_t);
+	if (!window || !bt) return -1;
+
+	start = fr_time();
+	for (i = 0; i < num_ops; i++) {
+		fr_message_t *m;
+
+		op_start = fr_time();
+
+		if (window[head]) {
+			(void) fr_message_done(window[head]);
+			window[head] = NULL;
+		}
+
+		m = fr_message_reserve(ms, packet_size);
+		if (!m) {
+			fprintf(stderr, "io_bench: Failed reserving message at %d: %s\n", i, fr_strerror());
+			return -1;
+		}
+
+		window[head] = fr_message_alloc(ms, m, packet_size);
+		head = (head + 1) % max_outstanding;
+
+		fr_time_histogram_add(&bt->latency, fr_time() - op_start);
+		bt->ops++;
+	}
+	end = fr_time();
+
+	bench_report("message_set", 1, 0, bt, 1, end - start);
+
+	if (debug_lvl) fr_message_set_debug(ms, stdout);
+
+	talloc_free(window);
+	talloc_free(bt);
+	talloc_free(ms);
+	return 0;
+}
+
+typedef struct {
+	char const	*name;
+	int		(*func)(TALLOC_CTX *ctx);
+} fr_bench_t;
+
+static fr_bench_t benchmarks[] = {
+	{ "atomic_queue", bench_atomic_queue },
+	{ "ring_buffer", bench_ring_buffer },
+	{ "message_set", bench_message_set },
+	{ NULL, NULL }
+};
+
+static int bench_run(TALLOC_CTX *ctx, char const *name)
+{
+	fr_bench_t *b;
+
+	for (b = benchmarks; b->name; b++) {
+		if (strcmp(b->name, name) != 0) continue;
+
+		MPRINT1("Running %s\n", b->name);
+		return b->func(ctx);
+	}
+
+	fprintf(stderr, "io_bench: Unknown benchmark '%s'\n", name);
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, rcode = 0;
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "B:c:hn:o:p:P:s:x")) != EOF) switch (c) {
+		case 'B':
+			burst = atoi(optarg);
+			break;
+
+		case 'c':
+			num_consumers = atoi(optarg);
+			break;
+
+		case 'n':
+			num_ops = atoi(optarg);
+			break;
+
+		case 'o':
+			max_outstanding = atoi(optarg);
+			break;
+
+		case 'p':
+			num_producers = atoi(optarg);
+			break;
+
+		case 'P':
+			packet_size = atoi(optarg);
+			break;
+
+		case 's':
+			queue_size = atoi(optarg);
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if ((num_producers < 1) || (num_consumers < 1) ||
+	    ((num_producers + num_consumers) > MAX_THREADS)) {
+		fprintf(stderr, "io_bench: Producers and consumers must be between 1 and %d in total\n", MAX_THREADS);
+		exit(1);
+	}
+
+	if ((num_ops < 1) || (burst < 1) || (burst > queue_size) || (max_outstanding < 1) || (queue_size < 2) || (packet_size < 1)) usage();
+
+	if (argc == 0) {
+		fr_bench_t *b;
+
+		for (b = benchmarks; b->name; b++) {
+			if (bench_run(autofree, b->name) < 0) rcode = 1;
+		}
+	} else {
+		for (i = 0; i < argc; i++) {
+			if (bench_run(autofree, argv[i]) < 0) rcode = 1;
+		}
+	}
+
+	talloc_free(autofree);
+
+	return rcode;
+}
@@ -0,0 +1,6 @@
+TARGET := io_bench
+
+SOURCES		:= io_bench.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a libfreeradius-io.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,596 @@
+/*
+ * radius_codec_bench.c	Benchmark the RADIUS packet decoder and encoder
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/net.h>
+#include <freeradius-devel/radius/radius.h>
+#include <freeradius-devel/io/time.h>
+#include <freeradius-devel/rad_assert.h>
+
+#ifdef HAVE_LIBPCAP
+#  include <freeradius-devel/pcap.h>
+#endif
+
+#include <ctype.h>
+#include <fcntl.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MPRINT1 if (debug_lvl) printf
+
+static int		debug_lvl = 0;
+static int		num_rounds = 10000;
+static char const	*corpus_dir = NULL;
+
+/*
+ *	The unit tests encode replies to a request with this
+ *	authenticator, and secret.
+ */
+static uint8_t const	original_vector[AUTH_VECTOR_LEN] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+
+static char		*secret;
+
+/** The shape of a packet, by the most expensive attribute it contains
+ *
+ *  Later entries win.
+ */
+typedef enum {
+	CODEC_CLASS_RFC = 0,
+	CODEC_CLASS_VSA,
+	CODEC_CLASS_EXTENDED,
+	CODEC_CLASS_TLV,
+	CODEC_CLASS_WIMAX,
+	CODEC_CLASS_TUNNEL,
+	CODEC_CLASS_MAX
+} codec_class_t;
+
+static char const *codec_class_names[CODEC_CLASS_MAX] = {
+	[CODEC_CLASS_RFC]	= "rfc",
+	[CODEC_CLASS_VSA]	= "vsa",
+	[CODEC_CLASS_EXTENDED]	= "extended",
+	[CODEC_CLASS_TLV]	= "tlv",
+	[CODEC_CLASS_WIMAX]	= "wimax",
+	[CODEC_CLASS_TUNNEL]	= "tunnel",
+};
+
+typedef struct codec_packet_t codec_packet_t;
+
+struct codec_packet_t {
+	uint8_t			*data;			//!< The whole packet.
+	size_t			data_len;
+	codec_class_t		class;
+	codec_packet_t		*next;
+};
+
+/*
+ *	All of the packets we've loaded, one list for each class.
+ */
+static codec_packet_t	*corpus[CODEC_CLASS_MAX];
+static int		corpus_num[CODEC_CLASS_MAX];
+static int		corpus_skipped;
+
+
+/**********************************************************************/
+typedef struct rad_request REQUEST;
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx);
+void verify_request(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request);
+void talloc_const_free(void const *ptr);
+
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx)
+{
+	return NULL;
+}
+
+void verify_request(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request)
+{
+}
+
+void talloc_const_free(void const *ptr)
+{
+	void *tmp;
+	if (!ptr) return;
+
+	memcpy(&tmp, &ptr, sizeof(tmp));
+	talloc_free(tmp);
+}
+/**********************************************************************/
+
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: radius_codec_bench [OPTS] file ...\n");
+	fprintf(stderr, "  -D <dictdir>           Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -n <rounds>            Number of times each packet is decoded and encoded.\n");
+	fprintf(stderr, "  -w <dir>               Write each packet of the corpus to a file in this directory,\n");
+	fprintf(stderr, "                         e.g. for use as the seed corpus of a fuzzer.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Files ending in \".txt\" are read as unit tests (see src/tests/unit).\n");
+#ifdef HAVE_LIBPCAP
+	fprintf(stderr, "All other files are read as pcap files, e.g. as written by radsniff.\n");
+#endif
+
+	exit(1);
+}
+
+/** Allocate the packets we decode into, and encode from
+ *
+ */
+static RADIUS_PACKET *packet_alloc(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len)
+{
+	RADIUS_PACKET *packet;
+
+	packet = fr_radius_alloc(ctx, false);
+	if (!packet) return NULL;
+
+	if (data) {
+		packet->data = talloc_memdup(packet, data, data_len);
+		packet->data_len = data_len;
+		packet->code = data[0];
+		packet->id = data[1];
+		memcpy(packet->vector, data + 4, sizeof(packet->vector));
+	}
+
+	return packet;
+}
+
+/** Figure out which class a packet belongs to
+ *
+ */
+static codec_class_t packet_class(VALUE_PAIR *vps)
+{
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+	codec_class_t	class = CODEC_CLASS_RFC;
+
+	for (vp = fr_pair_cursor_init(&cursor, &vps);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		fr_dict_attr_t const	*da;
+		codec_class_t		this = CODEC_CLASS_RFC;
+
+		if (vp->da->flags.encrypt == FLAG_ENCRYPT_TUNNEL_PASSWORD) {
+			this = CODEC_CLASS_TUNNEL;
+
+		} else if (vp->da->vendor == VENDORPEC_WIMAX) {
+			this = CODEC_CLASS_WIMAX;
+
+		} else {
+			for (da = vp->da->parent; da && !da->flags.is_root; da = da->parent) {
+				if (da->type == FR_TYPE_TLV) {
+					this = CODEC_CLASS_TLV;
+					break;
+				}
+
+				if ((da->type == FR_TYPE_EXTENDED) || (da->type == FR_TYPE_LONG_EXTENDED)) {
+					this = CODEC_CLASS_EXTENDED;
+				}
+			}
+
+			if ((this == CODEC_CLASS_RFC) && vp->da->vendor) this = CODEC_CLASS_VSA;
+		}
+
+		if (this > class) class = this;
+	}
+
+	return class;
+}
+
+/** Add a packet to the corpus
+ *
+ *  The packet is decoded and encoded once here, so that packets which
+ *  fail are skipped, instead of being timed.
+ */
+static void corpus_add(TALLOC_CTX *ctx, RADIUS_PACKET *original, uint8_t const *data, size_t data_len)
+{
+	size_t		packet_len = data_len;
+	decode_fail_t	reason;
+	RADIUS_PACKET	*packet, *reply;
+	codec_packet_t	*cp;
+
+	if ((data_len < RADIUS_HDR_LEN) || (data_len > MAX_PACKET_LEN) ||
+	    !fr_radius_ok(data, &packet_len, false, &reason)) {
+		corpus_skipped++;
+		return;
+	}
+
+	packet = packet_alloc(ctx, data, packet_len);
+	reply = packet_alloc(packet, NULL, 0);
+	if (!packet || !reply) {
+		fprintf(stderr, "radius_codec_bench: Out of memory\n");
+		exit(1);
+	}
+
+	if (fr_radius_packet_decode(packet, original, secret) < 0) {
+		MPRINT1("Skipping packet which doesn't decode: %s\n", fr_strerror());
+	skip:
+		corpus_skipped++;
+		talloc_free(packet);
+		return;
+	}
+
+	reply->code = packet->code;
+	reply->id = packet->id;
+	memcpy(reply->vector, packet->vector, sizeof(reply->vector));
+	reply->vps = packet->vps;
+
+	if (fr_radius_packet_encode(reply, original, secret) < 0) {
+		MPRINT1("Skipping packet which doesn't encode: %s\n", fr_strerror());
+		reply->vps = NULL;
+		goto skip;
+	}
+	reply->vps = NULL;
+
+	cp = talloc_zero(ctx, codec_packet_t);
+	if (!cp) {
+		fprintf(stderr, "radius_codec_bench: Out of memory\n");
+		exit(1);
+	}
+
+	cp->data = talloc_steal(cp, packet->data);
+	cp->data_len = packet_len;
+	cp->class = packet_class(packet->vps);
+
+	cp->next = corpus[cp->class];
+	corpus[cp->class] = cp;
+	corpus_num[cp->class]++;
+
+	talloc_free(packet);
+}
+
+/** Load the attributes from "decode" and "data" lines of a unit test file
+ *
+ *  Each line which is all hex is one or more encoded attributes, and
+ *  is wrapped in an Access-Accept.
+ */
+static int corpus_load_unit(TALLOC_CTX *ctx, RADIUS_PACKET *original, char const *filename)
+{
+	FILE	*fp;
+	char	line[8192];
+	uint8_t	data[MAX_PACKET_LEN];
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "radius_codec_bench: Failed opening %s: %s\n", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char		hex[sizeof(line)];
+		char const	*p;
+		char		*q;
+		size_t		len;
+
+		if (strncmp(line, "decode ", 7) == 0) {
+			p = line + 7;
+
+		} else if (strncmp(line, "data ", 5) == 0) {
+			p = line + 5;
+
+		} else {
+			continue;
+		}
+
+		/*
+		 *	Hex bytes, separated by spaces.  Anything else
+		 *	is an attribute list, or an error message.
+		 */
+		for (q = hex; *p; p++) {
+			if (isspace((int) *p)) continue;
+			if (!isxdigit((int) *p)) break;
+			*q++ = *p;
+		}
+		if (*p || (q == hex) || ((q - hex) & 0x01)) continue;
+
+		len = (q - hex) / 2;
+		if ((len + RADIUS_HDR_LEN) > sizeof(data)) continue;
+
+		memset(data, 0, RADIUS_HDR_LEN);
+		data[0] = FR_CODE_ACCESS_ACCEPT;
+		data[2] = ((len + RADIUS_HDR_LEN) >> 8) & 0xff;
+		data[3] = (len + RADIUS_HDR_LEN) & 0xff;
+
+		if (fr_hex2bin(data + RADIUS_HDR_LEN, len, hex, q - hex) != len) continue;
+
+		corpus_add(ctx, original, data, len + RADIUS_HDR_LEN);
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+#ifdef HAVE_LIBPCAP
+/** Load the RADIUS packets from a pcap file
+ *
+ *  Replies are decoded as if they were replies to the unit test
+ *  request.  Encrypted attributes in them will decode to garbage,
+ *  but cost the same.
+ */
+static int corpus_load_pcap(TALLOC_CTX *ctx, RADIUS_PACKET *original, char const *filename)
+{
+	fr_pcap_t		*in;
+	struct pcap_pkthdr	*header;
+	uint8_t const		*data;
+	int			ret;
+
+	in = fr_pcap_init(ctx, filename, PCAP_FILE_IN);
+	if (!in || (fr_pcap_open(in) < 0)) {
+		fprintf(stderr, "radius_codec_bench: Failed opening %s: %s\n", filename, fr_strerror());
+		talloc_free(in);
+		return -1;
+	}
+
+	while ((ret = pcap_next_ex(in->handle, &header, &data)) == 1) {
+		uint8_t const	*p = data, *end = data + header->caplen;
+		ssize_t		len;
+
+		len = fr_link_layer_offset(data, header->caplen, in->link_layer);
+		if (len < 0) continue;
+		p += len;
+
+		if (p >= end) continue;
+
+		switch ((p[0] & 0xf0) >> 4) {
+		case 4:
+			p += (0x0f & ((ip_header_t const *) p)->ip_vhl) * 4;
+			break;
+
+		case 6:
+			p += sizeof(ip_header6_t);
+			break;
+
+		default:
+			continue;
+		}
+
+		p += sizeof(udp_header_t);
+		if ((p + RADIUS_HDR_LEN) > end) continue;
+
+		corpus_add(ctx, original, p, end - p);
+	}
+
+	talloc_free(in);
+	return 0;
+}
+#endif
+
+/** Write the corpus out, one packet per file
+ *
+ */
+static int corpus_write(char const *dir)
+{
+	int		i, n;
+	codec_packet_t	*cp;
+	char		filename[PATH_MAX];
+
+	for (i = 0; i < CODEC_CLASS_MAX; i++) {
+		for (cp = corpus[i], n = 0; cp; cp = cp->next, n++) {
+			int fd;
+
+			snprintf(filename, sizeof(filename), "%s/%s-%04d", dir, codec_class_names[i], n);
+
+			fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0) {
+			error:
+				fprintf(stderr, "radius_codec_bench: Failed writing %s: %s\n", filename, fr_syserror(errno));
+				return -1;
+			}
+
+			if (write(fd, cp->data, cp->data_len) != (ssize_t) cp->data_len) {
+				close(fd);
+				goto error;
+			}
+			close(fd);
+		}
+	}
+
+	return 0;
+}
+
+/** Decode and encode each packet in a class, many times
+ *
+ *  The number of allocations is the number of talloc blocks the
+ *  decoded or encoded packet holds.  Temporary allocations which are
+ *  freed before the call returns are not counted.
+ *
+ *  Each decode gets a new packet, as unknown attributes are
+ *  allocated in the packet, and are only freed with it.
+ */
+static int bench_class(TALLOC_CTX *ctx, RADIUS_PACKET *original, codec_class_t class)
+{
+	int			i;
+	uint64_t		ops = 0, decode_blocks = 0, encode_blocks = 0;
+	fr_time_t		decode_time = 0, encode_time = 0;
+	fr_time_histogram_t	*decode_latency, *encode_latency;
+	codec_packet_t		*cp;
+	RADIUS_PACKET		*packet, *reply;
+	size_t			packet_blocks, reply_blocks;
+
+	if (!corpus[class]) return 0;
+
+	decode_latency = talloc_zero(ctx, fr_time_histogram_t);
+	encode_latency = talloc_zero(ctx, fr_time_histogram_t);
+	reply = packet_alloc(ctx, NULL, 0);
+	if (!decode_latency || !encode_latency || !reply) return -1;
+
+	reply_blocks = talloc_total_blocks(reply);
+
+	for (i = 0; i < num_rounds; i++) {
+		for (cp = corpus[class]; cp; cp = cp->next) {
+			fr_time_t start, end;
+
+			packet = packet_alloc(ctx, NULL, 0);
+			if (!packet) return -1;
+			packet_blocks = talloc_total_blocks(packet);
+
+			packet->data = cp->data;
+			packet->data_len = cp->data_len;
+			packet->code = cp->data[0];
+			packet->id = cp->data[1];
+			memcpy(packet->vector, cp->data + 4, sizeof(packet->vector));
+
+			start = fr_time();
+			if (fr_radius_packet_decode(packet, original, secret) < 0) {
+				fprintf(stderr, "radius_codec_bench: Failed decoding packet: %s\n", fr_strerror());
+				return -1;
+			}
+			end = fr_time();
+
+			decode_time += end - start;
+			fr_time_histogram_add(decode_latency, end - start);
+			decode_blocks += talloc_total_blocks(packet) - packet_blocks;
+
+			reply->code = packet->code;
+			reply->id = packet->id;
+			memcpy(reply->vector, packet->vector, sizeof(reply->vector));
+			reply->vps = packet->vps;
+
+			start = fr_time();
+			if (fr_radius_packet_encode(reply, original, secret) < 0) {
+				fprintf(stderr, "radius_codec_bench: Failed encoding packet: %s\n", fr_strerror());
+				return -1;
+			}
+			end = fr_time();
+
+			encode_time += end - start;
+			fr_time_histogram_add(encode_latency, end - start);
+			encode_blocks += talloc_total_blocks(reply) - reply_blocks;
+
+			reply->vps = NULL;
+			TALLOC_FREE(reply->data);
+			talloc_free(packet);
+
+			ops++;
+		}
+	}
+
+	printf("bench=radius_codec class=%s packets=%d rounds=%d ops=%" PRIu64
+	       " decode_ns_per_op=%.2f decode_p99_ns=%" PRIu64 " decode_allocs_per_op=%.2f"
+	       " encode_ns_per_op=%.2f encode_p99_ns=%" PRIu64 " encode_allocs_per_op=%.2f\n",
+	       codec_class_names[class], corpus_num[class], num_rounds, ops,
+	       ((double) decode_time) / ops, fr_time_histogram_percentile(decode_latency, 99.0),
+	       ((double) decode_blocks) / ops,
+	       ((double) encode_time) / ops, fr_time_histogram_percentile(encode_latency, 99.0),
+	       ((double) encode_blocks) / ops);
+
+	if (debug_lvl) {
+		fr_time_histogram_debug(decode_latency, "decode", stdout);
+		fr_time_histogram_debug(encode_latency, "encode", stdout);
+	}
+
+	talloc_free(decode_latency);
+	talloc_free(encode_latency);
+	talloc_free(reply);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int		c, i, rcode = 0;
+	char const	*dict_dir = DICTDIR;
+	fr_dict_t	*dict = NULL;
+	RADIUS_PACKET	*original;
+	uint8_t		original_data[RADIUS_HDR_LEN];
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	fr_time_start();
+
+	while ((c = getopt(argc, argv, "D:hn:w:x")) != EOF) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'n':
+			num_rounds = atoi(optarg);
+			break;
+
+		case 'w':
+			corpus_dir = optarg;
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if ((argc == 0) || (num_rounds < 1)) usage();
+
+	if (fr_dict_from_file(autofree, &dict, dict_dir, FR_DICTIONARY_FILE, "radius") < 0) {
+		fr_perror("radius_codec_bench");
+		exit(1);
+	}
+
+	secret = talloc_typed_strdup(autofree, "testing123");
+
+	memset(original_data, 0, sizeof(original_data));
+	original_data[0] = FR_CODE_ACCESS_REQUEST;
+	original_data[3] = RADIUS_HDR_LEN;
+	memcpy(original_data + 4, original_vector, sizeof(original_vector));
+
+	original = packet_alloc(autofree, original_data, sizeof(original_data));
+	if (!original) exit(1);
+
+	for (i = 0; i < argc; i++) {
+		size_t len = strlen(argv[i]);
+
+		MPRINT1("Loading %s\n", argv[i]);
+
+		if ((len > 4) && (strcmp(argv[i] + len - 4, ".txt") == 0)) {
+			if (corpus_load_unit(autofree, original, argv[i]) < 0) exit(1);
+			continue;
+		}
+
+#ifdef HAVE_LIBPCAP
+		if (corpus_load_pcap(autofree, original, argv[i]) < 0) exit(1);
+#else
+		fprintf(stderr, "radius_codec_bench: Can't read %s, as pcap support is not available\n", argv[i]);
+		exit(1);
+#endif
+	}
+
+	MPRINT1("Skipped %d packets which could not be decoded or encoded\n", corpus_skipped);
+
+	if (corpus_dir) {
+		if (corpus_write(corpus_dir) < 0) exit(1);
+	} else {
+		for (i = 0; i < CODEC_CLASS_MAX; i++) {
+			if (bench_class(autofree, original, i) < 0) rcode = 1;
+		}
+	}
+
+	talloc_free(autofree);
+
+	return rcode;
+}
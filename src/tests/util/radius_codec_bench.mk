@@ -0,0 +1,6 @@
+TARGET := radius_codec_bench
+
+SOURCES		:= radius_codec_bench.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-radius.a libfreeradius-io.a
+TGT_LDLIBS	:= $(LIBS) $(PCAP_LIBS)
@@ -0,0 +1,345 @@
+/*
+ * trie_test.c	Tests for longest prefix match tries
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2026  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/trie.h>
+
+#define TEST_CHECK(_x) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "%s[%d]: \"%s\" failed\n", __FILE__, __LINE__, #_x); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+#define NUM_PREFIXES	(500)
+#define NUM_LOOKUPS	(20000)
+
+static fr_ipaddr_t	prefixes[NUM_PREFIXES];
+static int		num_prefixes;
+static uint32_t		rand_state = 0x12345678;
+
+/*
+ *	xorshift, so that runs are repeatable.
+ */
+static uint32_t test_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+
+	return rand_state;
+}
+
+static uint8_t *addr_bytes(fr_ipaddr_t *ipaddr, unsigned int *max_bits)
+{
+	if (ipaddr->af == AF_INET) {
+		*max_bits = 32;
+		return (uint8_t *) &ipaddr->addr.v4.s_addr;
+	}
+
+	*max_bits = 128;
+	return ipaddr->addr.v6.s6_addr;
+}
+
+static void parse(fr_ipaddr_t *out, char const *str)
+{
+	TEST_CHECK(fr_inet_pton(out, str, -1, AF_UNSPEC, false, true) == 0);
+}
+
+/*
+ *	Whether the first "prefix" bits of "a" and "b" are the same.
+ */
+static bool prefix_match(fr_ipaddr_t const *prefix, fr_ipaddr_t const *ipaddr)
+{
+	uint8_t const	*a, *b;
+	unsigned int	max_bits, i;
+
+	if (prefix->af != ipaddr->af) return false;
+
+	a = addr_bytes((fr_ipaddr_t *) prefix, &max_bits);
+	b = addr_bytes((fr_ipaddr_t *) ipaddr, &max_bits);
+
+	for (i = 0; i < prefix->prefix; i++) {
+		uint8_t mask = 0x80 >> (i & 7);
+
+		if ((a[i >> 3] & mask) != (b[i >> 3] & mask)) return false;
+	}
+
+	return true;
+}
+
+static bool prefix_equal(fr_ipaddr_t const *a, fr_ipaddr_t const *b)
+{
+	return (a->prefix == b->prefix) && prefix_match(a, b);
+}
+
+/*
+ *	Fixed prefixes, with lengths on and off the 6 bit stride.
+ */
+static void test_fixed(void)
+{
+	static char const *v4[] = {
+		"0.0.0.0/0", "10.0.0.0/8", "10.1.0.0/16", "10.1.2.0/24", "10.1.2.3/32",
+		"172.16.0.0/12", "192.168.0.0/23", "192.168.1.128/25", "192.0.2.0/30", "192.0.2.1/32"
+	};
+	static char const *v6[] = {
+		"2001:db8::/32", "2001:db8:1::/48", "2001:db8:1:2::/64", "2001:db8:1:2::1/128",
+		"2001:db8:8000::/33", "fe80::/10", "fe80::1/127"
+	};
+	static struct {
+		char const	*addr;
+		char const	*match;
+	} lookups[] = {
+		{ "10.1.2.3",		"10.1.2.3/32" },
+		{ "10.1.2.4",		"10.1.2.0/24" },
+		{ "10.1.3.1",		"10.1.0.0/16" },
+		{ "10.2.0.1",		"10.0.0.0/8" },
+		{ "11.0.0.0",		"0.0.0.0/0" },
+		{ "172.31.255.255",	"172.16.0.0/12" },
+		{ "172.32.0.0",		"0.0.0.0/0" },
+		{ "192.168.1.127",	"192.168.0.0/23" },
+		{ "192.168.1.128",	"192.168.1.128/25" },
+		{ "192.168.2.0",	"0.0.0.0/0" },
+		{ "192.0.2.1",		"192.0.2.1/32" },
+		{ "192.0.2.3",		"192.0.2.0/30" },
+		{ "192.0.2.4",		"0.0.0.0/0" },
+		{ "255.255.255.255",	"0.0.0.0/0" },
+		{ "2001:db8:1:2::1",	"2001:db8:1:2::1/128" },
+		{ "2001:db8:1:2::2",	"2001:db8:1:2::/64" },
+		{ "2001:db8:1:3::1",	"2001:db8:1::/48" },
+		{ "2001:db8:2::1",	"2001:db8::/32" },
+		{ "2001:db8:8000::1",	"2001:db8:8000::/33" },
+		{ "2001:db9::",		NULL },
+		{ "fe80::",		"fe80::1/127" },
+		{ "fe80::2",		"fe80::/10" },
+		{ "febf:ffff::",	"fe80::/10" },
+		{ "fec0::",		NULL },
+		{ "::",			NULL },
+		{ "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff", NULL }
+	};
+	fr_trie_t	*trie;
+	fr_ipaddr_t	prefix, ipaddr, *found;
+	size_t		i;
+
+	trie = fr_trie_alloc(NULL);
+	TEST_CHECK(trie != NULL);
+
+	num_prefixes = 0;
+	for (i = 0; i < sizeof(v4) / sizeof(v4[0]); i++) parse(&prefixes[num_prefixes++], v4[i]);
+	for (i = 0; i < sizeof(v6) / sizeof(v6[0]); i++) parse(&prefixes[num_prefixes++], v6[i]);
+
+	for (i = 0; i < (size_t) num_prefixes; i++) TEST_CHECK(fr_trie_insert(trie, &prefixes[i], &prefixes[i]) == 0);
+
+	/*
+	 *	Duplicates are refused, and exact matches are found
+	 *	before compiling.
+	 */
+	parse(&prefix, "10.1.0.0/16");
+	TEST_CHECK(fr_trie_insert(trie, &prefix, &prefix) < 0);
+	TEST_CHECK(fr_trie_exact(trie, &prefix) == &prefixes[2]);
+	parse(&prefix, "10.1.0.0/17");
+	TEST_CHECK(fr_trie_exact(trie, &prefix) == NULL);
+	parse(&prefix, "10.0.0.0");
+	prefix.prefix = 33;
+	TEST_CHECK(fr_trie_insert(trie, &prefix, &prefix) < 0);
+
+	TEST_CHECK(fr_trie_compile(trie) == 0);
+
+	for (i = 0; i < sizeof(lookups) / sizeof(lookups[0]); i++) {
+		parse(&ipaddr, lookups[i].addr);
+		found = fr_trie_find(trie, NULL, &ipaddr);
+
+		if (!lookups[i].match) {
+			TEST_CHECK(found == NULL);
+			continue;
+		}
+
+		parse(&prefix, lookups[i].match);
+		TEST_CHECK(found != NULL);
+		TEST_CHECK(prefix_equal(found, &prefix));
+	}
+
+	talloc_free(trie);
+}
+
+/*
+ *	Walk back from the longest match with fr_trie_next.
+ */
+static void test_next(void)
+{
+	static char const *chain[] = { "10.1.2.3/32", "10.1.2.0/24", "10.1.0.0/16", "10.0.0.0/8", "0.0.0.0/0" };
+	fr_trie_t		*trie;
+	fr_trie_cursor_t	cursor;
+	fr_ipaddr_t		prefix, ipaddr, *found;
+	size_t			i;
+
+	trie = fr_trie_alloc(NULL);
+	TEST_CHECK(trie != NULL);
+
+	num_prefixes = 0;
+	for (i = 0; i < sizeof(chain) / sizeof(chain[0]); i++) {
+		parse(&prefixes[num_prefixes], chain[i]);
+		TEST_CHECK(fr_trie_insert(trie, &prefixes[num_prefixes], &prefixes[num_prefixes]) == 0);
+		num_prefixes++;
+	}
+
+	/*
+	 *	Not on the chain, so it must be skipped.
+	 */
+	parse(&prefix, "10.1.3.0/24");
+	TEST_CHECK(fr_trie_insert(trie, &prefix, &prefix) == 0);
+	TEST_CHECK(fr_trie_compile(trie) == 0);
+
+	parse(&ipaddr, "10.1.2.3");
+	found = fr_trie_find(trie, &cursor, &ipaddr);
+	for (i = 0; i < sizeof(chain) / sizeof(chain[0]); i++) {
+		TEST_CHECK(found == &prefixes[i]);
+		found = fr_trie_next(&cursor);
+	}
+	TEST_CHECK(found == NULL);
+	TEST_CHECK(fr_trie_next(&cursor) == NULL);
+
+	/*
+	 *	No match, so there's nothing to fall back to.
+	 */
+	parse(&ipaddr, "2001:db8::1");
+	TEST_CHECK(fr_trie_find(trie, &cursor, &ipaddr) == NULL);
+	TEST_CHECK(fr_trie_next(&cursor) == NULL);
+
+	talloc_free(trie);
+}
+
+/*
+ *	Random prefixes near a few base addresses, so that they nest,
+ *	checked against a linear search.
+ */
+static void test_random(int af)
+{
+	fr_trie_t		*trie;
+	fr_trie_cursor_t	cursor;
+	fr_ipaddr_t		base[4], ipaddr, *found, *expect;
+	uint8_t			*addr;
+	unsigned int		max_bits;
+	int			i, j, limit;
+
+	trie = fr_trie_alloc(NULL);
+	TEST_CHECK(trie != NULL);
+
+	if (af == AF_INET) {
+		parse(&base[0], "10.0.0.0");
+		parse(&base[1], "10.128.64.32");
+		parse(&base[2], "192.0.2.0");
+		parse(&base[3], "255.255.255.255");
+	} else {
+		parse(&base[0], "2001:db8::");
+		parse(&base[1], "2001:db8:8000:4000::2000");
+		parse(&base[2], "fe80::");
+		parse(&base[3], "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff");
+	}
+
+	num_prefixes = 0;
+	for (i = 0; i < NUM_PREFIXES; i++) {
+		fr_ipaddr_t *p = &prefixes[num_prefixes];
+		bool dup = false;
+
+		*p = base[test_rand() & 0x03];
+		addr = addr_bytes(p, &max_bits);
+		p->prefix = test_rand() % (max_bits + 1);
+
+		/*
+		 *	Flip a few bits, then clear the host bits.
+		 */
+		for (j = 0; j < 3; j++) {
+			unsigned int bit = test_rand() % max_bits;
+
+			addr[bit >> 3] ^= 0x80 >> (bit & 7);
+		}
+		fr_ipaddr_mask(p, p->prefix);
+
+		for (j = 0; j < num_prefixes; j++) {
+			if (prefix_equal(&prefixes[j], p)) {
+				dup = true;
+				break;
+			}
+		}
+
+		if (dup) {
+			TEST_CHECK(fr_trie_insert(trie, p, p) < 0);
+			continue;
+		}
+
+		TEST_CHECK(fr_trie_insert(trie, p, p) == 0);
+		num_prefixes++;
+	}
+
+	TEST_CHECK(fr_trie_compile(trie) == 0);
+
+	for (i = 0; i < NUM_LOOKUPS; i++) {
+		ipaddr = base[test_rand() & 0x03];
+		addr = addr_bytes(&ipaddr, &max_bits);
+
+		for (j = test_rand() % 5; j > 0; j--) {
+			unsigned int bit = test_rand() % max_bits;
+
+			addr[bit >> 3] ^= 0x80 >> (bit & 7);
+		}
+
+		found = fr_trie_find(trie, &cursor, &ipaddr);
+
+		/*
+		 *	Every prefix which matches, longest first.
+		 */
+		limit = max_bits + 1;
+		do {
+			expect = NULL;
+			for (j = 0; j < num_prefixes; j++) {
+				if (prefixes[j].prefix >= limit) continue;
+				if (!prefix_match(&prefixes[j], &ipaddr)) continue;
+				if (expect && (expect->prefix > prefixes[j].prefix)) continue;
+
+				expect = &prefixes[j];
+			}
+
+			TEST_CHECK(found == expect);
+			if (!expect) break;
+
+			limit = expect->prefix;
+			found = fr_trie_next(&cursor);
+		} while (true);
+	}
+
+	talloc_free(trie);
+}
+
+int main(UNUSED int argc, UNUSED char *argv[])
+{
+	test_fixed();
+	test_next();
+	test_random(AF_INET);
+	test_random(AF_INET6);
+
+	printf("OK\n");
+
+	return EXIT_SUCCESS;
+}